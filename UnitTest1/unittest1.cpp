@@ -48,6 +48,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(picohash_open)
+        {
+            int ret = picohash_open_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(picohash_bytes)
         {
             int ret = picohash_bytes_test();
@@ -62,6 +69,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(siphash13)
+        {
+            int ret = siphash13_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(picolog_basic)
         {
             int ret = picolog_basic_test();
@@ -69,6 +83,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(picolog_index)
+        {
+            int ret = picolog_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(bytestream)
         {
             int ret = bytestream_test();
@@ -146,6 +167,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(random_buffered)
+        {
+            int ret = random_buffered_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(sockloop_basic)
         {
             int ret = sockloop_basic_test();
@@ -202,6 +230,118 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(sockloop_batch)
+        {
+            int ret = sockloop_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_uring)
+        {
+            int ret = sockloop_uring_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_select)
+        {
+            int ret = sockloop_select_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_txtime)
+        {
+            int ret = sockloop_txtime_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_zerocopy)
+        {
+            int ret = sockloop_zerocopy_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_command)
+        {
+            int ret = sockloop_command_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_rio)
+        {
+            int ret = sockloop_rio_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_provider)
+        {
+            int ret = sockloop_provider_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_busy_poll)
+        {
+            int ret = sockloop_busy_poll_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_affinity)
+        {
+            int ret = sockloop_affinity_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_timer_slack)
+        {
+            int ret = sockloop_timer_slack_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_reuseport)
+        {
+            int ret = sockloop_reuseport_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_dispatch)
+        {
+            int ret = sockloop_dispatch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_gro)
+        {
+            int ret = sockloop_gro_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_timestamp)
+        {
+            int ret = sockloop_timestamp_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(sockloop_metrics)
+        {
+            int ret = sockloop_metrics_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(splay)
         {
             int ret = splay_test();
@@ -209,6 +349,27 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(rbtree)
+        {
+            int ret = rbtree_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(splay_bench)
+        {
+            int ret = splay_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(timer_wheel)
+        {
+            int ret = timer_wheel_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(create_cnx)
         {
             int ret = create_cnx_test();
@@ -216,6 +377,89 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(object_pool)
+        {
+            int ret = object_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(misc_frame_pool) {
+            int ret = misc_frame_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(packet_size_class)
+        {
+            int ret = packet_size_class_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(packet_index)
+        {
+            int ret = packet_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(ack_batch)
+        {
+            int ret = ack_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stateless_queue)
+        {
+            int ret = stateless_queue_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(prewarm_pools)
+        {
+            int ret = prewarm_pools_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(path_table)
+        {
+            int ret = path_table_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(loss_check_path)
+        {
+            int ret = loss_check_path_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cnx_layout)
+        {
+            int ret = cnx_layout_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(clock_cache)
+        {
+            int ret = clock_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(reset_filter)
+        {
+            int ret = reset_filter_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(create_quic)
         {
             int ret = create_quic_test();
@@ -265,6 +509,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(varint_bench)
+        {
+            int ret = varint_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(sqrt_for_test)
         {
             int ret = sqrt_for_test_test();
@@ -356,12 +607,33 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(stream_index)
+        {
+            int ret = stream_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(stream_output)
         {
             int ret = stream_output_test();
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(stream_scheduler)
+        {
+            int ret = stream_scheduler_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(stream_reassembly_ring)
+        {
+            int ret = stream_reassembly_ring_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         TEST_METHOD(stream_retransmit_copy)
         {
             int ret = test_copy_for_retransmit();
@@ -383,6 +655,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(dataqueue_bucket)
+        {
+            int ret = dataqueue_bucket_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(stateless_blowback) {
             int ret = test_stateless_blowback();
 
@@ -410,6 +689,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(sack_list_array)
+        {
+            int ret = sack_list_array_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(ack_disorder)
         {
             int ret = ack_disorder_test();
@@ -424,6 +710,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(ack_scan_floor)
+        {
+            int ret = ack_scan_floor_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(ack_range_cap)
+        {
+            int ret = ack_range_cap_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(ack_of_ack)
         {
             int ret = ack_of_ack_test();
@@ -445,6 +745,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(ackfrq_adaptive)
+        {
+            int ret = ackfrq_adaptive_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_sim_link)
         {
             int ret = sim_link_test();
@@ -452,6 +759,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(sim_link_sched)
+        {
+            int ret = sim_link_sched_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(cleartext_pn_enc)
         {
             int ret = cleartext_pn_enc_test();
@@ -459,6 +773,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(aead_seal_batch)
+        {
+            int ret = aead_seal_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(cid_for_lb)
         {
             int ret = cid_for_lb_test();
@@ -466,6 +787,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(cid_for_lb_batch)
+        {
+            int ret = cid_for_lb_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(lb_router)
+        {
+            int ret = lb_router_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(cid_for_lb_cli)
         {
             int ret = cid_for_lb_cli_test();
@@ -519,6 +854,13 @@ namespace UnitTest1
         {
             int ret = pacing_repeat_test();
 
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(pacing_precision)
+        {
+            int ret = pacing_precision_test();
+
             Assert::AreEqual(ret, 0);
         }
 
@@ -544,6 +886,30 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+        TEST_METHOD(async_sign)
+        {
+            int ret = async_sign_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(key_share_pool)
+        {
+            int ret = key_share_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(initial_key_cache)
+        {
+            int ret = initial_key_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(cert_compress)
+        {
+            int ret = cert_compress_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         TEST_METHOD(null_sni)
         {
             int ret = null_sni_test();
@@ -677,6 +1043,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(datagram_ring)
+        {
+            int ret = datagram_ring_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(datagram_wifi)
         {
             int ret = datagram_wifi_test();
@@ -858,6 +1231,97 @@ namespace UnitTest1
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(zero_copy_stream)
+		{
+			int ret = zero_copy_stream_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(stream_iov)
+		{
+			int ret = stream_iov_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(stream_cork)
+		{
+			int ret = stream_cork_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(stream_repeat_queue)
+		{
+			int ret = stream_repeat_queue_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(stream_repeat_strip)
+		{
+			int ret = stream_repeat_strip_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(cnx_handoff)
+		{
+			int ret = cnx_handoff_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(delivery_batch)
+		{
+			int ret = delivery_batch_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(send_backlog)
+		{
+			int ret = send_backlog_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(timer_slack)
+		{
+			int ret = timer_slack_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(stream_deadline)
+		{
+			int ret = stream_deadline_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(fec_repair)
+		{
+			int ret = fec_repair_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(preemptive_budget)
+		{
+			int ret = preemptive_budget_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(reorder_window)
+		{
+			int ret = reorder_window_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
         TEST_METHOD(stateless_reset_client)
         {
             int ret = stateless_reset_client_test();
@@ -907,6 +1371,48 @@ namespace UnitTest1
 			Assert::AreEqual(ret, 0);
 		}
 
+		TEST_METHOD(cnx_memory_budget)
+		{
+			int ret = cnx_memory_budget_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(rcv_window_autotune)
+		{
+			int ret = rcv_window_autotune_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(max_streams_autotune)
+		{
+			int ret = max_streams_autotune_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(in_place_decryption)
+		{
+			int ret = in_place_decryption_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(cnx_hibernation)
+		{
+			int ret = cnx_hibernation_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(prepare_next_packets)
+		{
+			int ret = prepare_next_packets_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
         TEST_METHOD(retry)
         {
             int ret = tls_api_retry_test();
@@ -921,6 +1427,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(admission_control)
+        {
+            int ret = admission_control_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(compact_closing)
+        {
+            int ret = compact_closing_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(retry_token)
         {
             int ret = tls_retry_token_test();
@@ -934,6 +1454,13 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(quic_group)
+        {
+            int ret = quic_group_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         
         TEST_METHOD(test_two_connections)
         {
@@ -1047,6 +1574,78 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+        TEST_METHOD(token_registry_flood)
+        {
+            int ret = token_registry_flood_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(initial_rate_limit)
+        {
+            int ret = initial_rate_limit_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(ticket_store_index)
+        {
+            int ret = ticket_store_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(shared_ticket_store)
+        {
+            int ret = shared_ticket_store_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(careful_resume)
+        {
+            int ret = careful_resume_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cc_snapshot)
+        {
+            int ret = cc_snapshot_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cc_fixed_point)
+        {
+            int ret = cc_fixed_point_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cc_hystart_pp)
+        {
+            int ret = cc_hystart_pp_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(cc_telemetry)
+        {
+            int ret = cc_telemetry_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(cnx_stats)
+        {
+            int ret = cnx_stats_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+        TEST_METHOD(cc_replay)
+        {
+            int ret = cc_replay_test();
+
+            Assert::AreEqual(ret, 0);
+        }
 
         TEST_METHOD(test_session_resume)
         {
@@ -1125,16 +1724,30 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
-        TEST_METHOD(mtu_required)
+        TEST_METHOD(mtu_required)
+        {
+            int ret = mtu_required_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(mtu_max)
+        {
+            int ret = mtu_max_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(mtu_jumbo)
         {
-            int ret = mtu_required_test();
+            int ret = mtu_jumbo_test();
 
             Assert::AreEqual(ret, 0);
         }
 
-        TEST_METHOD(mtu_max)
+        TEST_METHOD(pmtu_cache)
         {
-            int ret = mtu_max_test();
+            int ret = pmtu_cache_test();
 
             Assert::AreEqual(ret, 0);
         }
@@ -1348,6 +1961,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(test_transport_param_cache)
+        {
+            int ret = transport_param_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(test_bad_certificate)
         {
             int ret = bad_certificate_test();
@@ -1362,6 +1982,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(cert_verify_cache)
+        {
+            int ret = cert_verify_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(client_auth)
         {
           int ret = request_client_authentication_test();
@@ -1439,6 +2066,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(port_rebinding_fast)
+        {
+            int ret = port_rebinding_fast_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(spinbit)
         {
             int ret = spinbit_test();
@@ -1473,6 +2107,13 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(spinbit_observer)
+        {
+            int ret = spinbit_observer_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         TEST_METHOD(loss_bit)
         {
             int ret = loss_bit_test();
@@ -1550,6 +2191,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(zero_rtt_replay)
+        {
+            int ret = zero_rtt_replay_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(ticket_key_rotation)
+        {
+            int ret = ticket_key_rotation_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(cnxid_transmit)
         {
             int ret = transmit_cnxid_test();
@@ -1597,6 +2252,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(memlog_ring)
+        {
+            int ret = memlog_ring_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(migration)
         {
             int ret = migration_test();
@@ -1723,6 +2385,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(key_rotation_precompute)
+        {
+            int ret = key_rotation_precompute_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(key_rotation_stress)
         {
             int ret = key_rotation_stress_test();
@@ -1828,12 +2497,67 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(qlog_trace_async)
+        {
+            int ret = qlog_trace_async_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(qlog_trace_auto_async)
+        {
+            int ret = qlog_trace_auto_async_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(qlog_trace_compressed)
+        {
+            int ret = qlog_trace_compressed_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(qlog_trace_compressed_async)
+        {
+            int ret = qlog_trace_compressed_async_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(qlog_trace_seq)
+        {
+            int ret = qlog_trace_seq_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(qlog_trace_seq_async)
+        {
+            int ret = qlog_trace_seq_async_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(log_policy)
+        {
+            int ret = log_policy_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(perflog)
         {
             int ret = perflog_test();
 
             Assert::AreEqual(ret, 0);
         }
+        TEST_METHOD(cpu_accounting)
+        {
+            int ret = cpu_accounting_test();
+
+            Assert::AreEqual(ret, 0);
+        }
         TEST_METHOD(nat_rebinding_stress)
         {
             int ret = rebinding_stress_test();
@@ -1905,6 +2629,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(textlog_rate_limit)
+        {
+            int ret = textlog_rate_limit_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(idle_server)
         {
             int ret = idle_server_test();
@@ -2132,6 +2863,20 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(cc_ns_sweep)
+        {
+            int ret = cc_ns_sweep_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(cc_ns_cpu_cost)
+        {
+            int ret = cc_ns_cpu_cost_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(fastcc)
         {
             int ret = fastcc_test();
@@ -2378,6 +3123,12 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(limited_recv_batch) {
+            int ret = limited_recv_batch_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(send_stream_blocked) {
             int ret = send_stream_blocked_test();
 
@@ -2396,6 +3147,12 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(queue_network_view) {
+            int ret = queue_network_view_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(pacing_update) {
             int ret = pacing_update_test();
 
@@ -2472,6 +3229,30 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(cnx_wheel) {
+            int ret = cnx_wheel_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(race_cnx) {
+            int ret = race_cnx_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(egress_scheduler) {
+            int ret = egress_scheduler_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(congestion_manager) {
+            int ret = congestion_manager_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(cert_verify_bad_cert) {
             int ret = cert_verify_bad_cert_test();
 
@@ -2886,6 +3667,42 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(multipath_sched_rtt) {
+            int ret = multipath_sched_rtt_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_sched_capacity) {
+            int ret = multipath_sched_capacity_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_sched_redundant) {
+            int ret = multipath_sched_redundant_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_lia) {
+            int ret = multipath_lia_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_olia) {
+            int ret = multipath_olia_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(multipath_balia) {
+            int ret = multipath_balia_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(multipath_qlog) {
             int ret = multipath_qlog_test();
 
@@ -2952,12 +3769,24 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_priority) {
+            int ret = h3zero_priority_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_capsule) {
             int ret = h3zero_capsule_test();
 
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_capsule_parse) {
+            int ret = h3zero_capsule_parse_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_client_data) {
             int ret = h3zero_client_data_test();
 
@@ -2976,12 +3805,30 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(qpack_huffman_encode) {
+            int ret = qpack_huffman_encode_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(qpack_huffman_bench) {
+            int ret = qpack_huffman_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_parse_qpack) {
             int ret = h3zero_parse_qpack_test();
 
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_parse_qpack_borrowed) {
+            int ret = h3zero_parse_qpack_borrowed_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_prepare_qpack) {
             int ret = h3zero_prepare_qpack_test();
 
@@ -3012,6 +3859,36 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_qpack_dynamic) {
+            int ret = h3zero_qpack_dynamic_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_qpack_blocked) {
+            int ret = h3zero_qpack_blocked_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_qpack_no_block) {
+            int ret = h3zero_qpack_no_block_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_qpack_eviction) {
+            int ret = h3zero_qpack_eviction_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_qpack_error) {
+            int ret = h3zero_qpack_error_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_stream) {
             int ret = h3zero_stream_test();
 
@@ -3066,6 +3943,18 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_post_backpressure) {
+            int ret = h3zero_post_backpressure_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(demo_pipeline) {
+            int ret = demo_pipeline_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(demo_alpn) {
             int ret = demo_alpn_test();
 
@@ -3096,12 +3985,72 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(demo_file_encoding) {
+            int ret = demo_file_encoding_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(demo_server_file) {
             int ret = demo_server_file_test();
 
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(h3zero_file_cache) {
+            int ret = h3zero_file_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_file_cache_serve) {
+            int ret = h3zero_file_cache_serve_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_response_cache) {
+            int ret = h3zero_response_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_response_cache_serve) {
+            int ret = h3zero_response_cache_serve_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_path_router) {
+            int ret = h3zero_path_router_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_stream_index) {
+            int ret = h3zero_stream_index_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_datagram_queue) {
+            int ret = h3zero_datagram_queue_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(h3zero_cnx_pool) {
+            int ret = h3zero_cnx_pool_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(connect_udp) {
+            int ret = connect_udp_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(h3zero_satellite) {
             int ret = h3zero_satellite_test();
 
@@ -3228,6 +4177,13 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(ech_config_cache)
+        {
+            int ret = ech_config_cache_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(getter) {
             int ret = getter_test();
 
@@ -3269,6 +4225,12 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(picowt_baton_bench) {
+            int ret = picowt_baton_bench_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(picowt_baton_uri) {
             int ret = picowt_baton_uri_test();
 
@@ -3329,6 +4291,18 @@ namespace UnitTest1
             Assert::AreEqual(ret, 0);
         }
 
+        TEST_METHOD(quicperf_load) {
+            int ret = quicperf_load_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
+        TEST_METHOD(quicperf_histogram) {
+            int ret = quicperf_histogram_test();
+
+            Assert::AreEqual(ret, 0);
+        }
+
         TEST_METHOD(grease_quic_bit_one_way) {
             int ret = grease_quic_bit_one_way_test();
 
@@ -3352,5 +4326,11 @@ namespace UnitTest1
 
             Assert::AreEqual(ret, 0);
         }
+
+        TEST_METHOD(cplusplus_wrapper) {
+            int ret = cplusplus_wrapper_test();
+
+            Assert::AreEqual(ret, 0);
+        }
     };
 }
@@ -44,7 +44,7 @@
 #include <getopt.c>
 #endif 
 
-int wt_baton_client(char const* server_name, int server_port, char const* path, picoquic_quic_config_t * config);
+int wt_baton_client(char const* server_name, int server_port, char const* path, size_t nb_sessions, picoquic_quic_config_t * config);
 int baton_client_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
     void* callback_ctx, void* callback_arg);
 
@@ -56,8 +56,14 @@ static void usage(char const * sample_name)
     fprintf(stderr, " - version: baton protocol version,\n");
     fprintf(stderr, " - baton: initial version value,\n");
     fprintf(stderr, " - count: number of rounds,\n");
-    fprintf(stderr, " - inject: inject error for testing\n");
-    fprintf(stderr, "For example, set a path like /baton?count=17 to have 17 rounds of baton exchange.");
+    fprintf(stderr, " - inject: inject error for testing,\n");
+    fprintf(stderr, " - size: fixed size of the baton messages,\n");
+    fprintf(stderr, " - dgram: number of datagrams sent per turn,\n");
+    fprintf(stderr, " - dsize: size of the datagrams.\n");
+    fprintf(stderr, "For example, set a path like /baton?count=17 to have 17 rounds of baton exchange.\n");
+    fprintf(stderr, "Baton options:\n");
+    fprintf(stderr, "  -Y nb_sessions   Benchmark mode: run nb_sessions baton sessions on the\n");
+    fprintf(stderr, "                   connection and report message rates and latency.\n");
     picoquic_config_usage();
     exit(1);
 }
@@ -78,17 +84,32 @@ int main(int argc, char** argv)
     int ret = 0;
     picoquic_quic_config_t config;
     char option_string[512];
+    int nb_sessions = 0;
 #ifdef _WINDOWS
     WSADATA wsaData = { 0 };
     (void)WSA_START(MAKEWORD(2, 2), &wsaData);
 #endif
 
     picoquic_config_init(&config);
-    ret = picoquic_config_option_letters(option_string, sizeof(option_string), NULL);
+    memcpy(option_string, "Y:", 2);
+    option_string[2] = 0;
+    ret = picoquic_config_check_option_letters(option_string);
+    if (ret == 0) {
+        ret = picoquic_config_option_letters(option_string + 2, sizeof(option_string) - 2, NULL);
+    }
+    if (ret == 0 && picoquic_config_long_options(&argc, argv, &config) != 0) {
+        usage(argv[0]);
+    }
     if (ret == 0) {
         int opt;
         while ((opt = getopt(argc, argv, option_string)) != -1) {
-            if (picoquic_config_command_line(opt, &optind, argc, (char const**)argv, optarg, &config) != 0) {
+            if (opt == 'Y') {
+                if ((nb_sessions = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of sessions: %s\n", optarg);
+                    usage(argv[0]);
+                }
+            }
+            else if (picoquic_config_command_line(opt, &optind, argc, (char const**)argv, optarg, &config) != 0) {
                 usage(argv[0]);
                 ret = -1;
                 break;
@@ -96,7 +117,7 @@ int main(int argc, char** argv)
         }
     }
 
-    if (optind + 3 != argc){
+    if (ret != 0 || optind + 3 != argc){
         usage(argv[0]);
     }
     else {
@@ -104,7 +125,7 @@ int main(int argc, char** argv)
         int server_port = get_port(argv[0], argv[optind++]);
         char const * path = argv[optind];
 
-        ret = wt_baton_client(server_name, server_port, path, &config);
+        ret = wt_baton_client(server_name, server_port, path, (size_t)nb_sessions, &config);
 
         if (ret != 0) {
             fprintf(stderr, "Baton dropped, ret=%d\n", ret);
@@ -129,7 +150,7 @@ int main(int argc, char** argv)
 #define PICOQUIC_BATON_CLIENT_TOKEN_STORE "baton_token_store.bin";
 #define PICOQUIC_BATON_CLIENT_QLOG_DIR ".";
 
-int wt_baton_client(char const* server_name, int server_port, char const* path, picoquic_quic_config_t* config)
+int wt_baton_client(char const* server_name, int server_port, char const* path, size_t nb_sessions, picoquic_quic_config_t* config)
 {
     int ret = 0;
     struct sockaddr_storage server_address;
@@ -138,6 +159,8 @@ int wt_baton_client(char const* server_name, int server_port, char const* path,
     picoquic_cnx_t* cnx = NULL;
     uint64_t current_time = picoquic_current_time();
     wt_baton_ctx_t baton_ctx = { 0 };
+    wt_baton_bench_t* bench = NULL;
+    wt_baton_ctx_t* loop_ctx = &baton_ctx;
     h3zero_callback_ctx_t* h3_ctx = NULL;
     h3zero_stream_ctx_t* control_stream_ctx = NULL;
 
@@ -205,7 +228,24 @@ int wt_baton_client(char const* server_name, int server_port, char const* path,
             &cnx, &h3_ctx, &control_stream_ctx, current_time, sni);
     }
 
-    if (ret == 0) {
+    if (ret == 0 && nb_sessions > 0) {
+        /* In benchmark mode, the application runs several baton sessions
+        * in parallel on the same connection. The bench context holds the
+        * session contexts, and prepares and connects all of them.
+         */
+        if ((bench = wt_baton_bench_create(nb_sessions)) == NULL) {
+            fprintf(stderr, "Cannot allocate %zu baton sessions\n", nb_sessions);
+            ret = -1;
+        }
+        else {
+            loop_ctx = &bench->sessions[0];
+            ret = wt_baton_bench_connect(cnx, bench, h3_ctx, control_stream_ctx, sni, path);
+            if (ret != 0) {
+                fprintf(stderr, "Could not program the web transport sessions\n");
+            }
+        }
+    }
+    if (ret == 0 && bench == NULL) {
         /* At this stage, we have allocated the QUIC connection, the
         * HTTP3 context, and the control stream. This, and the parameters
         * encoded in the path, is enough to build the context of the
@@ -216,7 +256,7 @@ int wt_baton_client(char const* server_name, int server_port, char const* path,
         ret = wt_baton_prepare_context(cnx, &baton_ctx, h3_ctx, control_stream_ctx,
             sni, path);
     }
-    if (ret == 0) {
+    if (ret == 0 && bench == NULL) {
         /* Once the application context has been initialized, we pass it to the
         * "connect" request, with a pointer to the application specific callback.
         * Of course, other application would follow the same logic and implement their
@@ -268,7 +308,7 @@ int wt_baton_client(char const* server_name, int server_port, char const* path,
         * `baton_client_loop_cb` in our examples. We mainly use that
         * to exit the packet loop when the application is done.
          */
-        ret = picoquic_packet_loop(quic, 0, server_address.ss_family, 0, 0, 0, baton_client_loop_cb, &baton_ctx);
+        ret = picoquic_packet_loop(quic, 0, server_address.ss_family, 0, 0, 0, baton_client_loop_cb, loop_ctx);
     }
 
     /* Done. At this stage, we print out statistics, etc.
@@ -276,28 +316,33 @@ int wt_baton_client(char const* server_name, int server_port, char const* path,
     * "baton" application. Other applications will replace this
     * code and use their own logic.
      */
-    printf("Final baton state: %d\n", baton_ctx.baton_state);
-    printf("Nb turns: %d\n", baton_ctx.nb_turns);
-    /* print statistics per lane */
-    for (size_t i = 0; i < baton_ctx.nb_lanes; i++) {
-        printf("Lane %zu, first baton: 0x%02x, last sent: 0x%02x, last received: 0x%02x\n", i,
-            baton_ctx.lanes[i].first_baton, baton_ctx.lanes[i].baton, baton_ctx.lanes[i].baton_received);
+    if (bench != NULL) {
+        (void)wt_baton_bench_report(stdout, bench, picoquic_current_time());
     }
-    printf("Baton bytes received: %" PRIu64 "\n", baton_ctx.nb_baton_bytes_received);
-    printf("Baton bytes sent: %" PRIu64 "\n", baton_ctx.nb_baton_bytes_sent);
-    printf("datagrams sent: %d\n", baton_ctx.nb_datagrams_sent);
-    printf("datagrams received: %d\n", baton_ctx.nb_datagrams_received);
-    printf("datagrams bytes sent: %zu\n", baton_ctx.nb_datagram_bytes_sent);
-    printf("datagrams bytes received: %zu\n", baton_ctx.nb_datagram_bytes_received);
-    printf("Last sent datagram baton: 0x%02x\n", baton_ctx.baton_datagram_send_next);
-    printf("Last received datagram baton: 0x%02x\n", baton_ctx.baton_datagram_received);
-    if (baton_ctx.capsule.h3_capsule.is_stored) {
-        char log_text[256];
-        printf("Capsule received.\n");
-        printf("Error code: %lu\n", (unsigned long)baton_ctx.capsule.error_code);
-        printf("Error message: %s\n",
-            picoquic_uint8_to_str(log_text, sizeof(log_text), baton_ctx.capsule.error_msg,
-                baton_ctx.capsule.error_msg_len));
+    else {
+        printf("Final baton state: %d\n", baton_ctx.baton_state);
+        printf("Nb turns: %d\n", baton_ctx.nb_turns);
+        /* print statistics per lane */
+        for (size_t i = 0; i < baton_ctx.nb_lanes; i++) {
+            printf("Lane %zu, first baton: 0x%02x, last sent: 0x%02x, last received: 0x%02x\n", i,
+                baton_ctx.lanes[i].first_baton, baton_ctx.lanes[i].baton, baton_ctx.lanes[i].baton_received);
+        }
+        printf("Baton bytes received: %" PRIu64 "\n", baton_ctx.nb_baton_bytes_received);
+        printf("Baton bytes sent: %" PRIu64 "\n", baton_ctx.nb_baton_bytes_sent);
+        printf("datagrams sent: %d\n", baton_ctx.nb_datagrams_sent);
+        printf("datagrams received: %d\n", baton_ctx.nb_datagrams_received);
+        printf("datagrams bytes sent: %zu\n", baton_ctx.nb_datagram_bytes_sent);
+        printf("datagrams bytes received: %zu\n", baton_ctx.nb_datagram_bytes_received);
+        printf("Last sent datagram baton: 0x%02x\n", baton_ctx.baton_datagram_send_next);
+        printf("Last received datagram baton: 0x%02x\n", baton_ctx.baton_datagram_received);
+        if (baton_ctx.capsule.h3_capsule.is_stored) {
+            char log_text[256];
+            printf("Capsule received.\n");
+            printf("Error code: %lu\n", (unsigned long)baton_ctx.capsule.error_code);
+            printf("Error message: %s\n",
+                picoquic_uint8_to_str(log_text, sizeof(log_text), baton_ctx.capsule.error_msg,
+                    baton_ctx.capsule.error_msg_len));
+        }
     }
 
 
@@ -344,6 +389,8 @@ int wt_baton_client(char const* server_name, int server_port, char const* path,
         picoquic_free(quic);
     }
 
+    wt_baton_bench_delete(bench);
+
     return ret;
 }
 
@@ -27,6 +27,17 @@ extern "C" {
 #endif
     /* Initialize the memory log for a specific connection */
     int memlog_init(picoquic_cnx_t* cnx, size_t nb_lines, const char* memlog_file);
+
+    /* Initialize a memory log shared by all the connections of the context.
+     * The number of lines is set by the memory budget, in bytes. When the
+     * table is full, the new lines replace the oldest ones. If memlog_bin_file
+     * is not NULL, the lines are saved in that file when the context is freed.
+     * No memory is allocated after the initialization. */
+    int memlog_ring_init(picoquic_quic_t* quic, size_t memory_budget, const char* memlog_bin_file);
+    /* Save the current content of the shared memory log */
+    int memlog_ring_save(picoquic_quic_t* quic, const char* memlog_bin_file);
+    /* Convert a saved memory log to CSV, for all connections if cid is NULL */
+    int memlog_ring_to_csv(const char* memlog_bin_file, const char* csv_file, const picoquic_connection_id_t* cid);
 #ifdef __cplusplus
 }
 #endif
@@ -20,10 +20,14 @@
 */
 
 /*
-* Manage the qlog option, i.e. create a qlog upon completion of a binary log
+* Manage the qlog option. The binary log records of the connection are
+* converted to qlog as they are produced. If that is not possible, e.g.,
+* if the records are kept by the flight recorder, the qlog is created upon
+* completion of the binary log.
 */
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include "logreader.h"
 #include "bytestream.h"
 #include "qlog.h"
@@ -31,6 +35,27 @@
 #include "picoquic_binlog.h"
 #include "picoquic.h"
 
+static int autoqlog_file_name(picoquic_cnx_t* cnx, char* filename, size_t filename_size, char const* ext)
+{
+    char cid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
+    int ret = picoquic_print_connection_id_hexa(cid_name, sizeof(cid_name), &cnx->initial_cnxid);
+
+    if (ret == 0) {
+        if (cnx->quic->use_unique_log_names) {
+            ret = picoquic_sprintf(filename, filename_size, NULL, "%s%s%s.%x.%s.%s",
+                cnx->quic->qlog_dir, PICOQUIC_FILE_SEPARATOR, cid_name, cnx->log_unique,
+                (cnx->client_mode) ? "client" : "server", ext);
+        }
+        else {
+            ret = picoquic_sprintf(filename, filename_size, NULL, "%s%s%s.%s.%s",
+                cnx->quic->qlog_dir, PICOQUIC_FILE_SEPARATOR, cid_name,
+                (cnx->client_mode) ? "client" : "server", ext);
+        }
+    }
+
+    return ret;
+}
+
 int autoqlog(picoquic_cnx_t* cnx)
 {
     int ret = 0;
@@ -45,23 +70,9 @@ int autoqlog(picoquic_cnx_t* cnx)
     }
     else {
         char filename[512];
-        char cid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
-        int sprintf_ret = -1;
-
-        (void)picoquic_print_connection_id_hexa(cid_name, sizeof(cid_name), &cnx->initial_cnxid);
-        if (cnx->quic->use_unique_log_names) {
-            sprintf_ret = picoquic_sprintf(filename, sizeof(filename), NULL, "%s%s%s.%x.%s.%s",
-                cnx->quic->qlog_dir, PICOQUIC_FILE_SEPARATOR, cid_name, cnx->log_unique,
-                (cnx->client_mode) ? "client" : "server", "qlog");
-        }
-        else {
-            sprintf_ret = picoquic_sprintf(filename, sizeof(filename), NULL, "%s%s%s.%s.%s",
-                cnx->quic->qlog_dir, PICOQUIC_FILE_SEPARATOR, cid_name,
-                (cnx->client_mode) ? "client" : "server", "qlog");
-        }
 
-        if (sprintf_ret != 0) {
-            DBG_PRINTF("Cannot format file name for connection %s in file %s", cid_name, cnx->binlog_file_name);
+        if (autoqlog_file_name(cnx, filename, sizeof(filename), "qlog") != 0) {
+            DBG_PRINTF("Cannot format qlog file name for file %s", cnx->binlog_file_name);
             ret = -1;
             error_code = 3;
         }
@@ -100,11 +111,59 @@ int autoqlog(picoquic_cnx_t* cnx)
     return ret;
 }
 
+typedef struct st_autoqlog_stream_t {
+    picoquic_qlog_stream_t stream; /* Must be first, see picoquic_qlog_stream_t */
+    qlog_stream_t* qlog;
+} autoqlog_stream_t;
+
+static void autoqlog_stream_record(picoquic_qlog_stream_t* stream, const uint8_t* bytes, size_t length)
+{
+    autoqlog_stream_t* as = (autoqlog_stream_t*)stream;
+
+    (void)qlog_stream_record(as->qlog, bytes, length);
+}
+
+static void autoqlog_stream_close(picoquic_qlog_stream_t* stream)
+{
+    autoqlog_stream_t* as = (autoqlog_stream_t*)stream;
+
+    (void)qlog_stream_close(as->qlog);
+    free(as);
+}
+
+static picoquic_qlog_stream_t* autoqlog_stream_open(picoquic_cnx_t* cnx)
+{
+    autoqlog_stream_t* as = NULL;
+    char filename[512];
+
+    if (autoqlog_file_name(cnx, filename, sizeof(filename), (cnx->quic->is_qlog_json_seq) ? "sqlog" : "qlog") == 0 &&
+        (as = (autoqlog_stream_t*)malloc(sizeof(autoqlog_stream_t))) != NULL) {
+        memset(as, 0, sizeof(autoqlog_stream_t));
+        as->stream.record_fn = autoqlog_stream_record;
+        as->stream.close_fn = autoqlog_stream_close;
+        /* Same flags as the binary log file header */
+        if ((as->qlog = qlog_stream_open(&cnx->initial_cnxid, filename,
+            (cnx->local_parameters.is_multipath_enabled) ? 1 : 0, cnx->quic->is_qlog_json_seq)) == NULL) {
+            DBG_PRINTF("Cannot open qlog file %s", filename);
+            free(as);
+            as = NULL;
+        }
+    }
+
+    return (as == NULL) ? NULL : &as->stream;
+}
+
 int picoquic_set_qlog(picoquic_quic_t* quic, char const* qlog_dir)
 {
     quic->autoqlog_fn = autoqlog; 
+    quic->qlog_stream_open_fn = autoqlog_stream_open;
     picoquic_enable_binlog(quic);
     quic->qlog_dir = picoquic_string_free(quic->qlog_dir);
     quic->qlog_dir = picoquic_string_duplicate(qlog_dir);
     return 0;
-}
\ No newline at end of file
+}
+
+void picoquic_set_qlog_json_seq(picoquic_quic_t* quic, int is_json_seq)
+{
+    quic->is_qlog_json_seq = (is_json_seq) ? 1 : 0;
+}
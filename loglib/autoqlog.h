@@ -28,16 +28,27 @@ extern "C" {
 #include "picoquic.h"
 /* Set the qlog log folder and start generating per connection qlog traces into it.
     * Set to NULL value to stop binary tracing.
-    * If the binary folder is not set, binary traces will be generated temporarily in
-    * the qlog folder during the connection, and then deleted after the connection
-    * is closed and the binary trace has been converted to qlog.
-    * This conversion from binary to qlog consumes resource and can affect performance.
-    * Applications that are concerned about the performance issues should not use this
-    * option, and should instead use binary logs, from which qlogs can be extracted
+    * The binary trace records are converted to qlog as they are produced, in
+    * the asynchronous binlog writer thread if picoquic_set_binlog_async is used.
+    * If the binary folder is set, the binary traces are also kept.
+    * If the records cannot be converted as they are produced, e.g. when they are
+    * kept by the flight recorder of picoquic_set_log_policy, binary traces are
+    * generated temporarily in the qlog folder during the connection, and then
+    * deleted after the connection is closed and the trace has been converted to qlog.
+    * The conversion consumes resource and can affect performance. Applications
+    * that are concerned about the performance issues should not use this option,
+    * and should instead use binary logs, from which qlogs can be extracted
     * using the picolog_t app.
     */
 int picoquic_set_qlog(picoquic_quic_t* quic, char const* qlog_dir);
 
+/* Write the qlog traces in the JSON-SEQ format, with one record per event,
+ * in files with the extension ".sqlog". The events keep the array format
+ * described by the "event_fields" of the trace. This only applies to the
+ * traces converted as they are produced.
+ */
+void picoquic_set_qlog_json_seq(picoquic_quic_t* quic, int is_json_seq);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,563 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Columnar export of the congestion control log.
+*
+* The picoquic_log_event_cc_update events are written as an Apache Arrow IPC
+* file (https://arrow.apache.org/docs/format/Columnar.html), so that large
+* collections of logs can be analyzed without the cost of parsing csv text.
+* The file is made of:
+*
+* - the magic string "ARROW1", padded to 8 bytes,
+* - a schema message, describing one 64 bits integer column per csv field,
+* - a series of record batch messages, each holding up to ARROW_CC_BATCH_ROWS
+*   rows stored column by column, without validity bitmaps since all values
+*   are present,
+* - an end of stream marker, then a footer repeating the schema and listing
+*   the position of the record batches, its length, and the magic string.
+*
+* The messages and the footer are encoded as flatbuffers. They are simple and
+* fixed enough to be composed directly, without depending on a flatbuffers
+* library: the tables are written before the objects that they refer to, so
+* all offsets point forward, and the fields are aligned on their size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "logreader.h"
+#include "picoquic_binlog.h"
+#include "bytestream.h"
+#include "csv.h"
+#include "cc_arrow.h"
+
+#define ARROW_CC_BATCH_ROWS 16384
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+
+static const struct {
+    char const* name;
+    int is_signed;
+} arrow_cc_columns[] = {
+    { "time", 0 },
+    { "path", 0 },
+    { "sequence", 0 },
+    { "highest_ack", 1 },
+    { "high_ack_time", 0 },
+    { "last_time_ack", 0 },
+    { "cwin", 0 },
+    { "one_way_delay", 0 },
+    { "rtt_sample", 0 },
+    { "srtt", 0 },
+    { "rtt_min", 0 },
+    { "bandwidth", 0 },
+    { "receive_rate", 0 },
+    { "send_mtu", 0 },
+    { "pacing_packet_time", 0 },
+    { "nb_retrans", 0 },
+    { "nb_spurious", 0 },
+    { "cwin_blocked", 0 },
+    { "flow_blocked", 0 },
+    { "stream_blocked", 0 },
+    { "app_limited", 0 },
+    { "cc_state", 0 },
+    { "cc_param", 0 },
+    { "bw_max", 0 },
+    { "bytes_in_transit", 0 }
+};
+
+#define ARROW_CC_NB_COLUMNS (sizeof(arrow_cc_columns) / sizeof(arrow_cc_columns[0]))
+
+typedef struct st_arrow_fb_t {
+    uint8_t* bytes;
+    size_t length;
+    size_t size;
+    int error;
+} arrow_fb_t;
+
+/* A table field, of 1, 2, 4 or 8 bytes, or absent if the size is 0.
+ * Offsets to other objects are 4 bytes fields, patched later. */
+typedef struct st_arrow_fb_field_t {
+    size_t size;
+    uint64_t value;
+    size_t pos;
+} arrow_fb_field_t;
+
+typedef struct st_arrow_block_t {
+    uint64_t offset;
+    uint64_t metadata_length;
+    uint64_t body_length;
+} arrow_block_t;
+
+typedef struct st_arrow_cc_writer_t {
+    FILE* f;
+    uint64_t file_offset;
+    uint64_t starttime;
+    int idx;
+    size_t nb_rows;
+    uint64_t* rows;
+    uint8_t* body;
+    arrow_block_t* blocks;
+    size_t nb_blocks;
+    size_t blocks_size;
+    arrow_fb_t fb;
+} arrow_cc_writer_t;
+
+static void arrow_fb_put(arrow_fb_t* fb, const void* data, size_t length)
+{
+    if (fb->length + length > fb->size) {
+        size_t size = (fb->size == 0) ? 1024 : fb->size;
+        uint8_t* bytes;
+
+        while (size < fb->length + length) {
+            size *= 2;
+        }
+        if ((bytes = (uint8_t*)realloc(fb->bytes, size)) == NULL) {
+            fb->error = 1;
+            return;
+        }
+        fb->bytes = bytes;
+        fb->size = size;
+    }
+    if (data == NULL) {
+        memset(fb->bytes + fb->length, 0, length);
+    }
+    else {
+        memcpy(fb->bytes + fb->length, data, length);
+    }
+    fb->length += length;
+}
+
+/* Values are stored little endian, in the flatbuffers and in the record batches */
+static void arrow_set_uint(uint8_t* bytes, uint64_t value, size_t nb_bytes)
+{
+    for (size_t i = 0; i < nb_bytes; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void arrow_fb_uint(arrow_fb_t* fb, uint64_t value, size_t nb_bytes)
+{
+    uint8_t bytes[8];
+
+    arrow_set_uint(bytes, value, nb_bytes);
+    arrow_fb_put(fb, bytes, nb_bytes);
+}
+
+static void arrow_fb_set_uint(arrow_fb_t* fb, size_t pos, uint64_t value, size_t nb_bytes)
+{
+    if (pos + nb_bytes <= fb->length) {
+        arrow_set_uint(fb->bytes + pos, value, nb_bytes);
+    }
+}
+
+/* Pad with zeroes, so that length + delta is a multiple of align */
+static void arrow_fb_align(arrow_fb_t* fb, size_t align, size_t delta)
+{
+    size_t rem = (fb->length + delta) % align;
+
+    if (rem != 0) {
+        arrow_fb_put(fb, NULL, align - rem);
+    }
+}
+
+/* Set the offset stored at position "at" to refer to the object at "target" */
+static void arrow_fb_patch(arrow_fb_t* fb, size_t at, size_t target)
+{
+    arrow_fb_set_uint(fb, at, target - at, 4);
+}
+
+/* Write the vtable, then the table. The table starts 4 bytes before a multiple
+ * of 8, so that after its vtable offset the fields can be laid out by decreasing
+ * size without padding. Returns the position of the table. */
+static size_t arrow_fb_table(arrow_fb_t* fb, arrow_fb_field_t* fields, size_t nb_fields)
+{
+    size_t vtable_size = 4 + 2 * nb_fields;
+    size_t table_size = 4;
+    size_t vtable_pos;
+    size_t table_pos;
+    size_t pos;
+
+    for (size_t i = 0; i < nb_fields; i++) {
+        table_size += fields[i].size;
+    }
+    arrow_fb_align(fb, 8, vtable_size + 4);
+    vtable_pos = fb->length;
+    table_pos = vtable_pos + vtable_size;
+    pos = table_pos + 4;
+    for (size_t size = 8; size > 0; size /= 2) {
+        for (size_t i = 0; i < nb_fields; i++) {
+            if (fields[i].size == size) {
+                fields[i].pos = pos;
+                pos += size;
+            }
+        }
+    }
+
+    arrow_fb_uint(fb, vtable_size, 2);
+    arrow_fb_uint(fb, table_size, 2);
+    for (size_t i = 0; i < nb_fields; i++) {
+        arrow_fb_uint(fb, (fields[i].size == 0) ? 0 : fields[i].pos - table_pos, 2);
+    }
+    arrow_fb_uint(fb, table_pos - vtable_pos, 4);
+    for (size_t size = 8; size > 0; size /= 2) {
+        for (size_t i = 0; i < nb_fields; i++) {
+            if (fields[i].size == size) {
+                arrow_fb_uint(fb, fields[i].value, size);
+            }
+        }
+    }
+
+    return table_pos;
+}
+
+/* Reserve a vector of nb_elements, with the elements aligned on align bytes.
+ * Returns the position of the first element; the vector itself starts 4 bytes
+ * before, with the number of elements. */
+static size_t arrow_fb_vector(arrow_fb_t* fb, size_t nb_elements, size_t element_size, size_t align)
+{
+    size_t pos;
+
+    arrow_fb_align(fb, align, 4);
+    arrow_fb_uint(fb, nb_elements, 4);
+    pos = fb->length;
+    arrow_fb_put(fb, NULL, nb_elements * element_size);
+
+    return pos;
+}
+
+static size_t arrow_fb_string(arrow_fb_t* fb, char const* s)
+{
+    size_t pos;
+    size_t length = strlen(s);
+
+    arrow_fb_align(fb, 4, 0);
+    pos = fb->length;
+    arrow_fb_uint(fb, length, 4);
+    arrow_fb_put(fb, s, length);
+    arrow_fb_put(fb, NULL, 1);
+
+    return pos;
+}
+
+static size_t arrow_cc_schema(arrow_fb_t* fb)
+{
+    /* Endianness absent, i.e., little endian, then the vector of fields */
+    arrow_fb_field_t schema[2] = { { 0, 0, 0 }, { 4, 0, 0 } };
+    size_t schema_pos = arrow_fb_table(fb, schema, 2);
+    size_t fields_pos = arrow_fb_vector(fb, ARROW_CC_NB_COLUMNS, 4, 4);
+
+    arrow_fb_patch(fb, schema[1].pos, fields_pos - 4);
+    for (size_t i = 0; i < ARROW_CC_NB_COLUMNS; i++) {
+        /* Name, nullable, type type, type, dictionary, children */
+        arrow_fb_field_t field[6] = { { 4, 0, 0 }, { 1, 0, 0 }, { 1, ARROW_TYPE_INT, 0 }, { 4, 0, 0 }, { 0, 0, 0 }, { 4, 0, 0 } };
+        arrow_fb_field_t int_type[2] = { { 4, 64, 0 }, { 1, (uint64_t)arrow_cc_columns[i].is_signed, 0 } };
+        size_t field_pos = arrow_fb_table(fb, field, 6);
+
+        arrow_fb_patch(fb, fields_pos + 4 * i, field_pos);
+        arrow_fb_patch(fb, field[0].pos, arrow_fb_string(fb, arrow_cc_columns[i].name));
+        arrow_fb_patch(fb, field[3].pos, arrow_fb_table(fb, int_type, 2));
+        arrow_fb_patch(fb, field[5].pos, arrow_fb_vector(fb, 0, 4, 4) - 4);
+    }
+
+    return schema_pos;
+}
+
+/* Start a message. Returns the position of the header offset, to be patched */
+static size_t arrow_fb_message(arrow_fb_t* fb, uint8_t header_type, uint64_t body_length)
+{
+    /* Version, header type, header, body length */
+    arrow_fb_field_t message[4] = { { 2, ARROW_METADATA_V5, 0 }, { 1, header_type, 0 }, { 4, 0, 0 }, { 8, body_length, 0 } };
+
+    fb->length = 0;
+    arrow_fb_uint(fb, 0, 4);
+    arrow_fb_patch(fb, 0, arrow_fb_table(fb, message, 4));
+
+    return message[2].pos;
+}
+
+/* Write the message as an encapsulated message: continuation marker, metadata
+ * length, metadata padded to 8 bytes, then the body. */
+static int arrow_write_message(arrow_cc_writer_t* w, const uint8_t* body, size_t body_length, arrow_block_t* block)
+{
+    int ret = 0;
+    uint8_t prefix[8];
+
+    arrow_fb_align(&w->fb, 8, 0);
+    if (w->fb.error) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        arrow_set_uint(prefix, 0xFFFFFFFF, 4);
+        arrow_set_uint(prefix + 4, w->fb.length, 4);
+        if (fwrite(prefix, 1, sizeof(prefix), w->f) != sizeof(prefix) ||
+            fwrite(w->fb.bytes, 1, w->fb.length, w->f) != w->fb.length ||
+            (body_length > 0 && fwrite(body, 1, body_length, w->f) != body_length)) {
+            ret = -1;
+        }
+        else {
+            if (block != NULL) {
+                block->offset = w->file_offset;
+                block->metadata_length = sizeof(prefix) + w->fb.length;
+                block->body_length = body_length;
+            }
+            w->file_offset += sizeof(prefix) + w->fb.length + body_length;
+        }
+    }
+
+    return ret;
+}
+
+static int arrow_cc_write_batch(arrow_cc_writer_t* w)
+{
+    int ret = 0;
+    size_t column_length = w->nb_rows * 8;
+    size_t body_length = column_length * ARROW_CC_NB_COLUMNS;
+
+    if (w->nb_blocks >= w->blocks_size) {
+        size_t blocks_size = (w->blocks_size == 0) ? 16 : 2 * w->blocks_size;
+        arrow_block_t* blocks = (arrow_block_t*)realloc(w->blocks, blocks_size * sizeof(arrow_block_t));
+
+        if (blocks == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            w->blocks = blocks;
+            w->blocks_size = blocks_size;
+        }
+    }
+
+    if (ret == 0) {
+        /* Length, nodes, buffers */
+        arrow_fb_field_t batch[3] = { { 8, w->nb_rows, 0 }, { 4, 0, 0 }, { 4, 0, 0 } };
+        size_t header_at = arrow_fb_message(&w->fb, ARROW_HEADER_RECORD_BATCH, body_length);
+        size_t nodes_pos;
+        size_t buffers_pos;
+
+        arrow_fb_patch(&w->fb, header_at, arrow_fb_table(&w->fb, batch, 3));
+        nodes_pos = arrow_fb_vector(&w->fb, ARROW_CC_NB_COLUMNS, 16, 8);
+        arrow_fb_patch(&w->fb, batch[1].pos, nodes_pos - 4);
+        buffers_pos = arrow_fb_vector(&w->fb, 2 * ARROW_CC_NB_COLUMNS, 16, 8);
+        arrow_fb_patch(&w->fb, batch[2].pos, buffers_pos - 4);
+
+        for (size_t i = 0; i < ARROW_CC_NB_COLUMNS; i++) {
+            uint8_t* column = w->body + i * column_length;
+
+            /* Field node: length and null count, then an empty validity buffer and the values */
+            arrow_fb_set_uint(&w->fb, nodes_pos + 16 * i, w->nb_rows, 8);
+            arrow_fb_set_uint(&w->fb, buffers_pos + 32 * i, i * column_length, 8);
+            arrow_fb_set_uint(&w->fb, buffers_pos + 32 * i + 16, i * column_length, 8);
+            arrow_fb_set_uint(&w->fb, buffers_pos + 32 * i + 24, column_length, 8);
+            for (size_t j = 0; j < w->nb_rows; j++) {
+                arrow_set_uint(column + 8 * j, w->rows[j * ARROW_CC_NB_COLUMNS + i], 8);
+            }
+        }
+
+        ret = arrow_write_message(w, w->body, body_length, &w->blocks[w->nb_blocks]);
+        if (ret == 0) {
+            w->nb_blocks++;
+            w->nb_rows = 0;
+        }
+    }
+
+    return ret;
+}
+
+static int arrow_cc_write_footer(arrow_cc_writer_t* w)
+{
+    int ret = 0;
+    uint8_t eos[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0 };
+    uint8_t trailer[10];
+    /* Version, schema, dictionaries, record batches */
+    arrow_fb_field_t footer[4] = { { 2, ARROW_METADATA_V5, 0 }, { 4, 0, 0 }, { 4, 0, 0 }, { 4, 0, 0 } };
+    size_t footer_pos;
+    size_t batches_pos;
+
+    w->fb.length = 0;
+    arrow_fb_uint(&w->fb, 0, 4);
+    footer_pos = arrow_fb_table(&w->fb, footer, 4);
+    arrow_fb_patch(&w->fb, 0, footer_pos);
+    arrow_fb_patch(&w->fb, footer[1].pos, arrow_cc_schema(&w->fb));
+    arrow_fb_patch(&w->fb, footer[2].pos, arrow_fb_vector(&w->fb, 0, 24, 8) - 4);
+    batches_pos = arrow_fb_vector(&w->fb, w->nb_blocks, 24, 8);
+    arrow_fb_patch(&w->fb, footer[3].pos, batches_pos - 4);
+    for (size_t i = 0; i < w->nb_blocks; i++) {
+        /* Offset, metadata length and 4 bytes of padding, body length */
+        arrow_fb_set_uint(&w->fb, batches_pos + 24 * i, w->blocks[i].offset, 8);
+        arrow_fb_set_uint(&w->fb, batches_pos + 24 * i + 8, w->blocks[i].metadata_length, 4);
+        arrow_fb_set_uint(&w->fb, batches_pos + 24 * i + 16, w->blocks[i].body_length, 8);
+    }
+
+    arrow_set_uint(trailer, w->fb.length, 4);
+    memcpy(trailer + 4, "ARROW1", 6);
+
+    if (w->fb.error) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if (fwrite(eos, 1, sizeof(eos), w->f) != sizeof(eos) ||
+        fwrite(w->fb.bytes, 1, w->fb.length, w->f) != w->fb.length ||
+        fwrite(trailer, 1, sizeof(trailer), w->f) != sizeof(trailer)) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int arrow_cc_writer_init(arrow_cc_writer_t* w, FILE* f_arrow)
+{
+    int ret = 0;
+    uint8_t magic[8] = { 'A', 'R', 'R', 'O', 'W', '1', 0, 0 };
+
+    memset(w, 0, sizeof(arrow_cc_writer_t));
+    w->f = f_arrow;
+    w->rows = (uint64_t*)malloc(ARROW_CC_BATCH_ROWS * ARROW_CC_NB_COLUMNS * sizeof(uint64_t));
+    w->body = (uint8_t*)malloc(ARROW_CC_BATCH_ROWS * ARROW_CC_NB_COLUMNS * 8);
+
+    if (w->rows == NULL || w->body == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if (fwrite(magic, 1, sizeof(magic), f_arrow) != sizeof(magic)) {
+        ret = -1;
+    }
+    else {
+        size_t header_at = arrow_fb_message(&w->fb, ARROW_HEADER_SCHEMA, 0);
+
+        arrow_fb_patch(&w->fb, header_at, arrow_cc_schema(&w->fb));
+        w->file_offset = sizeof(magic);
+        ret = arrow_write_message(w, NULL, 0, NULL);
+    }
+
+    return ret;
+}
+
+static void arrow_cc_writer_release(arrow_cc_writer_t* w)
+{
+    free(w->rows);
+    free(w->body);
+    free(w->blocks);
+    free(w->fb.bytes);
+    memset(w, 0, sizeof(arrow_cc_writer_t));
+}
+
+static int arrow_cc_cb(bytestream* s, void* ptr)
+{
+    arrow_cc_writer_t* w = (arrow_cc_writer_t*)ptr;
+    int ret = 0;
+    picoquic_connection_id_t cid;
+    uint64_t time = 0;
+    uint64_t path_id = 0;
+    uint64_t id = 0;
+
+    ret |= byteread_cid(s, &cid);
+    ret |= byteread_vint(s, &time);
+    ret |= byteread_vint(s, &path_id);
+    ret |= byteread_vint(s, &id);
+
+    /* Same time reference as the csv file */
+    if (w->idx == 0) {
+        w->starttime = time;
+    }
+    w->idx++;
+    time -= w->starttime;
+
+    if (ret == 0 && id == picoquic_log_event_cc_update) {
+        picoquic_cc_update_record_t r;
+
+        if ((ret = picoquic_cc_update_decode(s, &r)) == 0) {
+            uint64_t* row = w->rows + w->nb_rows * ARROW_CC_NB_COLUMNS;
+            uint64_t values[ARROW_CC_NB_COLUMNS] = {
+                time, path_id, r.sequence, r.highest_ack, r.high_ack_time, r.last_time_ack,
+                r.cwin, r.one_way_delay, r.rtt_sample, r.SRTT, r.RTT_min, r.bandwidth_estimate,
+                r.receive_rate_estimate, r.Send_MTU, r.pacing_packet_time, r.nb_retrans, r.nb_spurious,
+                r.cwin_blkd, r.flow_blkd, r.stream_blkd, r.app_limited, r.cc_state, r.cc_param,
+                r.bw_max, r.bytes_in_transit };
+
+            memcpy(row, values, sizeof(values));
+            if (++w->nb_rows >= ARROW_CC_BATCH_ROWS) {
+                ret = arrow_cc_write_batch(w);
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int arrow_cc_writer_finish(arrow_cc_writer_t* w, int ret)
+{
+    if (ret == 0 && w->nb_rows > 0) {
+        ret = arrow_cc_write_batch(w);
+    }
+    if (ret == 0) {
+        ret = arrow_cc_write_footer(w);
+    }
+    arrow_cc_writer_release(w);
+
+    return ret;
+}
+
+int picoquic_cc_bin_to_arrow(FILE* f_binlog, FILE* f_arrow)
+{
+    arrow_cc_writer_t w;
+    int ret = arrow_cc_writer_init(&w, f_arrow);
+
+    if (ret == 0) {
+        ret = fileread_binlog(f_binlog, arrow_cc_cb, &w);
+    }
+
+    return arrow_cc_writer_finish(&w, ret);
+}
+
+int picoquic_cc_bin_to_arrow_indexed(const binlog_index_t* index, const picoquic_connection_id_t* cid, FILE* f_arrow)
+{
+    arrow_cc_writer_t w;
+    int ret = arrow_cc_writer_init(&w, f_arrow);
+
+    if (ret == 0) {
+        ret = binlog_index_read(index, cid, arrow_cc_cb, &w);
+    }
+
+    return arrow_cc_writer_finish(&w, ret);
+}
+
+int picoquic_cc_log_file_to_arrow(char const* bin_cc_log_name, char const* arrow_cc_log_name)
+{
+    int ret = 0;
+    uint64_t log_time = 0;
+    uint16_t flags;
+    FILE* f_binlog = picoquic_open_cc_log_file_for_read(bin_cc_log_name, &flags, &log_time);
+    FILE* f_arrow = picoquic_file_open(arrow_cc_log_name, "wb");
+
+    if (f_binlog == NULL || f_arrow == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = picoquic_cc_bin_to_arrow(f_binlog, f_arrow);
+    }
+    (void)picoquic_file_close(f_arrow);
+    (void)picoquic_file_close(f_binlog);
+
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef CC_ARROW_H
+#define CC_ARROW_H
+
+#include <stdio.h>
+#include "picoquic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct st_binlog_index_t;
+
+/* Extract the picoquic_log_event_cc_update events from the binary log, and write them
+ * as an Apache Arrow IPC file, version 5 of the format, with one typed 64 bits integer
+ * column per field of the csv file. The file can be read directly by common data
+ * analysis tools, for example pyarrow.ipc.open_file, pandas.read_feather, polars or
+ * DuckDB, without parsing text. Rows are written in record batches of up to 16384 rows.
+ */
+int picoquic_cc_log_file_to_arrow(char const* bin_cc_log_name, char const* arrow_cc_log_name);
+int picoquic_cc_bin_to_arrow(FILE* f_binlog, FILE* f_arrow);
+/* Same as picoquic_cc_bin_to_arrow, for the events of a single connection read from an index. */
+int picoquic_cc_bin_to_arrow_indexed(const struct st_binlog_index_t* index, const picoquic_connection_id_t* cid, FILE* f_arrow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CC_ARROW_H */
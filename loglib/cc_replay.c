@@ -0,0 +1,726 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Offline replay of congestion control.
+*
+* The replay reads the binary log of a connection, and reconstructs the events
+* seen by the sender of the logging endpoint: 1-RTT packets sent, ACK frames
+* received, and packets declared lost. These events are fed to a congestion
+* control algorithm, which may differ from the one used when the log was
+* recorded. The algorithm runs against the path of a connection context that
+* is never started: the replay maintains the path variables that the loss
+* recovery code would maintain, such as bytes in transit, delivered bytes,
+* RTT and bandwidth estimates, and calls the algorithm's notify function the
+* same way the stack does.
+*
+* This is an open loop replay. The packets are sent at the logged times, so
+* the replay shows how the algorithm would react to the recorded ACK and loss
+* stream, not how the network would have reacted to a different sending rate.
+* Losses are the ones declared by the recorded stack.
+*
+* Each ACK and loss event produces one CSV line, with the resulting window,
+* pacing rate and algorithm state, and the window logged at the time of the
+* event, if any, for comparison.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "bytestream.h"
+#include "logreader.h"
+#include "cc_replay.h"
+
+#define PICOQUIC_CC_REPLAY_PATH_MAX 16
+#define PICOQUIC_CC_REPLAY_ACK_DELAY_EXPONENT 3
+
+typedef struct st_cc_replay_packet_t {
+    uint64_t sequence;
+    uint64_t send_time;
+    uint64_t length;
+    uint64_t delivered_prior;
+    uint64_t delivered_time_prior;
+    uint64_t delivered_sent_prior;
+    uint64_t lost_prior;
+    uint64_t inflight_prior;
+    unsigned int is_ack_eliciting : 1;
+    unsigned int is_app_limited : 1;
+    unsigned int is_cwnd_limited : 1;
+    unsigned int is_done : 1;
+} cc_replay_packet_t;
+
+typedef struct st_cc_replay_path_t {
+    uint64_t unique_path_id;
+    picoquic_path_t* path_x;
+    /* Packets sent and not yet acknowledged or lost, by increasing number */
+    cc_replay_packet_t* packets;
+    size_t first_packet;
+    size_t nb_packets;
+    size_t nb_alloc;
+    /* Acknowledgements found in the packet being received */
+    uint64_t data_acked;
+    cc_replay_packet_t largest_acked;
+    int has_acked;
+    /* Last window value logged by the recorded stack */
+    uint64_t logged_cwin;
+} cc_replay_path_t;
+
+typedef struct st_cc_replay_ctx_t {
+    picoquic_congestion_algorithm_t const* alg;
+    char const* option_string;
+    FILE* f_csv;
+    picoquic_quic_t* quic;
+    picoquic_cnx_t* cnx;
+    uint64_t simulated_time;
+    uint64_t start_time;
+    int is_multipath;
+    /* Packet being processed */
+    int rxtx;
+    uint64_t packet_time;
+    uint64_t packet_path_id;
+    uint64_t packet_sequence;
+    uint64_t packet_length;
+    int is_1rtt;
+    int is_ack_eliciting;
+    uint64_t ack_delay;
+    int nb_paths;
+    cc_replay_path_t paths[PICOQUIC_CC_REPLAY_PATH_MAX];
+    picoquic_cc_replay_stats_t stats;
+} cc_replay_ctx_t;
+
+static int cc_replay_create_cnx(cc_replay_ctx_t* ctx, uint64_t time)
+{
+    int ret = 0;
+
+    if (ctx->cnx == NULL) {
+        struct sockaddr_in addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(443);
+        ctx->simulated_time = time;
+        ctx->start_time = time;
+        ctx->quic = picoquic_create(1, NULL, NULL, NULL, "replay", NULL, NULL, NULL, NULL, NULL,
+            time, &ctx->simulated_time, NULL, NULL, 0);
+        if (ctx->quic != NULL) {
+            ctx->cnx = picoquic_create_cnx(ctx->quic, picoquic_null_connection_id, picoquic_null_connection_id,
+                (struct sockaddr*)&addr, time, 0, "replay", "replay", 1);
+        }
+        if (ctx->cnx == NULL) {
+            DBG_PRINTF("%s", "Cannot create the replay connection context.");
+            ret = -1;
+        }
+        else {
+            /* The replay only covers the data phase of the connection */
+            ctx->cnx->cnx_state = picoquic_state_ready;
+            picoquic_set_congestion_algorithm_ex(ctx->cnx, ctx->alg, ctx->option_string);
+            ctx->paths[0].path_x = ctx->cnx->path[0];
+            ctx->nb_paths = 1;
+        }
+    }
+
+    return ret;
+}
+
+static cc_replay_path_t* cc_replay_get_path(cc_replay_ctx_t* ctx, uint64_t unique_path_id, uint64_t time)
+{
+    cc_replay_path_t* r_path = NULL;
+
+    if (!ctx->is_multipath) {
+        unique_path_id = 0;
+    }
+
+    if (ctx->cnx != NULL || cc_replay_create_cnx(ctx, time) == 0) {
+        for (int i = 0; i < ctx->nb_paths; i++) {
+            if (ctx->paths[i].unique_path_id == unique_path_id) {
+                r_path = &ctx->paths[i];
+                break;
+            }
+        }
+        if (r_path == NULL && ctx->nb_paths < PICOQUIC_CC_REPLAY_PATH_MAX) {
+            int path_id = picoquic_create_path(ctx->cnx, time, NULL,
+                (struct sockaddr*)&ctx->cnx->path[0]->first_tuple->peer_addr, 0, unique_path_id);
+
+            if (path_id >= 0) {
+                r_path = &ctx->paths[ctx->nb_paths++];
+                r_path->unique_path_id = unique_path_id;
+                r_path->path_x = ctx->cnx->path[path_id];
+                ctx->alg->alg_init(ctx->cnx, r_path->path_x, ctx->option_string, time);
+            }
+        }
+    }
+
+    return r_path;
+}
+
+/* Index of the first packet numbered at least sequence. The packets are
+ * sorted by sequence number */
+static size_t cc_replay_lower_bound(cc_replay_path_t* r_path, uint64_t sequence)
+{
+    size_t low = r_path->first_packet;
+    size_t high = r_path->nb_packets;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (r_path->packets[middle].sequence < sequence) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+static cc_replay_packet_t* cc_replay_find_packet(cc_replay_path_t* r_path, uint64_t sequence)
+{
+    size_t index = cc_replay_lower_bound(r_path, sequence);
+
+    return (index < r_path->nb_packets && r_path->packets[index].sequence == sequence) ?
+        &r_path->packets[index] : NULL;
+}
+
+static void cc_replay_prune_packets(cc_replay_path_t* r_path)
+{
+    while (r_path->first_packet < r_path->nb_packets && r_path->packets[r_path->first_packet].is_done) {
+        r_path->first_packet++;
+    }
+    if (r_path->first_packet > 0 && r_path->first_packet >= r_path->nb_packets / 2) {
+        r_path->nb_packets -= r_path->first_packet;
+        memmove(r_path->packets, r_path->packets + r_path->first_packet, r_path->nb_packets * sizeof(cc_replay_packet_t));
+        r_path->first_packet = 0;
+    }
+}
+
+static int cc_replay_add_packet(cc_replay_ctx_t* ctx, cc_replay_path_t* r_path)
+{
+    int ret = 0;
+    picoquic_path_t* path_x = r_path->path_x;
+
+    if (r_path->nb_packets > r_path->first_packet &&
+        r_path->packets[r_path->nb_packets - 1].sequence >= ctx->packet_sequence) {
+        /* Out of order logging, should not happen. Ignore the packet. */
+        return 0;
+    }
+
+    if (r_path->nb_packets >= r_path->nb_alloc) {
+        size_t new_alloc = (r_path->nb_alloc == 0) ? 256 : 2 * r_path->nb_alloc;
+        cc_replay_packet_t* new_packets = (cc_replay_packet_t*)realloc(r_path->packets, new_alloc * sizeof(cc_replay_packet_t));
+        if (new_packets == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            r_path->packets = new_packets;
+            r_path->nb_alloc = new_alloc;
+        }
+    }
+
+    if (ret == 0) {
+        cc_replay_packet_t* packet = &r_path->packets[r_path->nb_packets++];
+
+        memset(packet, 0, sizeof(cc_replay_packet_t));
+        packet->sequence = ctx->packet_sequence;
+        packet->send_time = ctx->packet_time;
+        packet->length = ctx->packet_length;
+        packet->delivered_prior = path_x->delivered_last;
+        packet->delivered_time_prior = path_x->delivered_time_last;
+        packet->delivered_sent_prior = path_x->delivered_sent_last;
+        packet->lost_prior = path_x->total_bytes_lost;
+        packet->inflight_prior = path_x->bytes_in_transit;
+        packet->is_ack_eliciting = ctx->is_ack_eliciting;
+        packet->is_app_limited = (path_x->delivered_limited_index != 0);
+        packet->is_cwnd_limited = (path_x->bytes_in_transit >= path_x->cwin);
+        if (packet->is_ack_eliciting) {
+            path_x->bytes_in_transit += packet->length;
+        }
+        /* Keep the sequence numbers used by picoquic_cc_get_sequence_number */
+        path_x->pkt_ctx.send_sequence = ctx->packet_sequence + 1;
+        if (r_path->unique_path_id == 0) {
+            ctx->cnx->pkt_ctx[picoquic_packet_context_application].send_sequence = ctx->packet_sequence + 1;
+        }
+        ctx->stats.nb_packets_sent++;
+    }
+
+    return ret;
+}
+
+static void cc_replay_remove_in_transit(picoquic_path_t* path_x, cc_replay_packet_t* packet)
+{
+    if (packet->is_ack_eliciting) {
+        path_x->bytes_in_transit = (path_x->bytes_in_transit > packet->length) ?
+            path_x->bytes_in_transit - packet->length : 0;
+    }
+    packet->is_done = 1;
+}
+
+static int cc_replay_write_row(cc_replay_ctx_t* ctx, cc_replay_path_t* r_path, char const* event,
+    uint64_t nb_bytes, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_path_t* path_x = r_path->path_x;
+    uint64_t cc_state = 0;
+    uint64_t cc_param = 0;
+
+    if (path_x->congestion_alg_state != NULL && ctx->alg->alg_observe != NULL) {
+        ctx->alg->alg_observe(path_x, &cc_state, &cc_param);
+    }
+    if (path_x->cwin > ctx->stats.cwin_max) {
+        ctx->stats.cwin_max = path_x->cwin;
+    }
+    ctx->stats.nb_rows++;
+
+    if (ctx->f_csv != NULL && fprintf(ctx->f_csv, "%" PRIu64 ", %" PRIu64 ", %s, %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
+        current_time - ctx->start_time, r_path->unique_path_id, event, nb_bytes,
+        path_x->rtt_sample, path_x->smoothed_rtt, path_x->rtt_min, path_x->bandwidth_estimate,
+        path_x->bytes_in_transit, path_x->cwin, path_x->pacing.rate, path_x->pacing.packet_time_microsec,
+        cc_state, cc_param, r_path->logged_cwin) <= 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Process the ACK frames of a received packet, once all frames have been read.
+ * This follows process_decoded_packet_data.
+ */
+static int cc_replay_process_acks(cc_replay_ctx_t* ctx, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = ctx->cnx;
+
+    for (int i = 0; ret == 0 && i < ctx->nb_paths; i++) {
+        cc_replay_path_t* r_path = &ctx->paths[i];
+        picoquic_path_t* path_x = r_path->path_x;
+
+        if (!r_path->has_acked) {
+            continue;
+        }
+        picoquic_update_path_rtt(cnx, path_x, path_x, picoquic_epoch_1rtt,
+            r_path->largest_acked.send_time, current_time, ctx->ack_delay, 0);
+        picoquic_estimate_path_bandwidth(cnx, path_x, r_path->largest_acked.send_time,
+            r_path->largest_acked.delivered_prior, r_path->largest_acked.delivered_time_prior,
+            r_path->largest_acked.delivered_sent_prior, current_time, current_time,
+            r_path->largest_acked.is_app_limited);
+        picoquic_estimate_max_path_bandwidth(cnx, path_x, r_path->largest_acked.send_time,
+            current_time, current_time);
+
+        if (path_x->rtt_sample > 0) {
+            picoquic_per_ack_state_t ack_state = { 0 };
+            ack_state.rtt_measurement = path_x->rtt_sample;
+            ack_state.nb_bytes_acknowledged = r_path->data_acked;
+            ack_state.nb_bytes_lost_since_packet_sent = path_x->total_bytes_lost - r_path->largest_acked.lost_prior;
+            ack_state.nb_bytes_delivered_since_packet_sent = path_x->delivered - r_path->largest_acked.delivered_prior;
+            ack_state.inflight_prior = r_path->largest_acked.inflight_prior;
+            ack_state.is_app_limited = r_path->largest_acked.is_app_limited;
+            ack_state.is_cwnd_limited = r_path->largest_acked.is_cwnd_limited;
+            ctx->alg->alg_notify(cnx, path_x, picoquic_congestion_notification_acknowledgement,
+                &ack_state, current_time);
+        }
+        ctx->stats.nb_acks++;
+        ctx->stats.bytes_acked += r_path->data_acked;
+        ret = cc_replay_write_row(ctx, r_path, "ack", r_path->data_acked, current_time);
+
+        r_path->has_acked = 0;
+        r_path->data_acked = 0;
+        cc_replay_prune_packets(r_path);
+    }
+
+    return ret;
+}
+
+static void cc_replay_ack_range(cc_replay_ctx_t* ctx, cc_replay_path_t* r_path, uint64_t lowest, uint64_t highest)
+{
+    picoquic_path_t* path_x = r_path->path_x;
+    size_t index = cc_replay_lower_bound(r_path, lowest);
+
+    for (; index < r_path->nb_packets && r_path->packets[index].sequence <= highest; index++) {
+        cc_replay_packet_t* packet = &r_path->packets[index];
+
+        if (!packet->is_done) {
+            path_x->delivered += packet->length;
+            if (packet->is_ack_eliciting) {
+                path_x->last_time_acked_data_frame_sent = packet->send_time;
+            }
+            if (!r_path->has_acked || packet->sequence > r_path->largest_acked.sequence) {
+                r_path->largest_acked = *packet;
+                r_path->has_acked = 1;
+            }
+            r_path->data_acked += packet->length;
+            cc_replay_remove_in_transit(path_x, packet);
+        }
+    }
+    if (r_path->has_acked) {
+        picoquic_packet_context_t* pkt_ctx = &path_x->pkt_ctx;
+
+        if (highest > pkt_ctx->highest_acknowledged || pkt_ctx->highest_acknowledged == UINT64_MAX) {
+            pkt_ctx->highest_acknowledged = highest;
+            pkt_ctx->latest_time_acknowledged = r_path->largest_acked.send_time;
+        }
+        if (r_path->unique_path_id == 0) {
+            pkt_ctx = &ctx->cnx->pkt_ctx[picoquic_packet_context_application];
+            if (highest > pkt_ctx->highest_acknowledged || pkt_ctx->highest_acknowledged == UINT64_MAX) {
+                pkt_ctx->highest_acknowledged = highest;
+                pkt_ctx->latest_time_acknowledged = r_path->largest_acked.send_time;
+            }
+        }
+    }
+}
+
+static int cc_replay_ack_frame(cc_replay_ctx_t* ctx, uint64_t ftype, bytestream* s)
+{
+    int ret = 0;
+    uint64_t path_id = 0;
+    uint64_t largest = 0;
+    uint64_t ack_delay = 0;
+    uint64_t num = 0;
+    cc_replay_path_t* r_path;
+
+    if (ftype == picoquic_frame_type_path_ack || ftype == picoquic_frame_type_path_ack_ecn) {
+        ret |= byteread_vint(s, &path_id);
+        ctx->is_multipath = 1;
+    }
+    ret |= byteread_vint(s, &largest);
+    ret |= byteread_vint(s, &ack_delay);
+    ret |= byteread_vint(s, &num);
+    r_path = (ret == 0) ? cc_replay_get_path(ctx, path_id, ctx->packet_time) : NULL;
+
+    if (r_path != NULL) {
+        ctx->ack_delay = ack_delay << PICOQUIC_CC_REPLAY_ACK_DELAY_EXPONENT;
+        for (uint64_t i = 0; ret == 0 && i <= num; i++) {
+            uint64_t range = 0;
+
+            if (i != 0) {
+                uint64_t skip = 0;
+                ret |= byteread_vint(s, &skip);
+                if (largest < skip + 1) {
+                    break;
+                }
+                largest -= skip + 1;
+            }
+            ret |= byteread_vint(s, &range);
+            if (ret != 0 || range > largest) {
+                break;
+            }
+            cc_replay_ack_range(ctx, r_path, largest - range, largest);
+            if (largest == range) {
+                break;
+            }
+            largest -= range + 1;
+        }
+    }
+
+    /* A malformed frame in the log is not a replay error */
+    return 0;
+}
+
+static int cc_replay_connection_start(uint64_t time, const picoquic_connection_id_t* cid, int client_mode,
+    uint32_t proposed_version, const picoquic_connection_id_t* remote_cnxid, void* ptr)
+{
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)ptr;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cid);
+    UNREFERENCED_PARAMETER(client_mode);
+    UNREFERENCED_PARAMETER(proposed_version);
+    UNREFERENCED_PARAMETER(remote_cnxid);
+#endif
+    return cc_replay_create_cnx(ctx, time);
+}
+
+static int cc_replay_ignore_stream(uint64_t time, bytestream* s, void* ptr)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(time);
+    UNREFERENCED_PARAMETER(s);
+    UNREFERENCED_PARAMETER(ptr);
+#endif
+    return 0;
+}
+
+static int cc_replay_ignore_path_stream(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(time);
+    UNREFERENCED_PARAMETER(path_id);
+    UNREFERENCED_PARAMETER(s);
+    UNREFERENCED_PARAMETER(ptr);
+#endif
+    return 0;
+}
+
+static int cc_replay_pdu(uint64_t time, int rxtx, bytestream* s, void* ptr)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(time);
+    UNREFERENCED_PARAMETER(rxtx);
+    UNREFERENCED_PARAMETER(s);
+    UNREFERENCED_PARAMETER(ptr);
+#endif
+    return 0;
+}
+
+static int cc_replay_packet_start(uint64_t time, uint64_t path_id, uint64_t size, const picoquic_packet_header* ph, int rxtx, void* ptr)
+{
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)ptr;
+
+    ctx->rxtx = rxtx;
+    ctx->packet_time = time;
+    ctx->packet_path_id = path_id;
+    ctx->packet_sequence = ph->pn64;
+    ctx->packet_length = size;
+    ctx->is_1rtt = (ph->ptype == picoquic_packet_1rtt_protected || (!rxtx && ph->ptype == picoquic_packet_0rtt_protected));
+    ctx->is_ack_eliciting = 0;
+    ctx->ack_delay = 0;
+    if (path_id != 0) {
+        ctx->is_multipath = 1;
+    }
+    ctx->simulated_time = time;
+
+    return (ctx->cnx == NULL) ? cc_replay_create_cnx(ctx, time) : 0;
+}
+
+static int cc_replay_packet_frame(bytestream* s, void* ptr)
+{
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)ptr;
+    int ret = 0;
+
+    if (ctx->is_1rtt) {
+        const uint8_t* bytes = bytestream_ptr(s);
+        size_t length = bytestream_remain(s);
+        uint64_t ftype = 0;
+
+        if (byteread_vint(s, &ftype) == 0) {
+            if (ctx->rxtx) {
+                if (ftype == picoquic_frame_type_ack || ftype == picoquic_frame_type_ack_ecn ||
+                    ftype == picoquic_frame_type_path_ack || ftype == picoquic_frame_type_path_ack_ecn) {
+                    ret = cc_replay_ack_frame(ctx, ftype, s);
+                }
+            }
+            else if (!ctx->is_ack_eliciting) {
+                size_t consumed = 0;
+                int pure_ack = 0;
+
+                /* Logged stream frames may be truncated, so a parsing error means data */
+                if (picoquic_skip_frame(bytes, length, &consumed, &pure_ack) != 0 || !pure_ack) {
+                    ctx->is_ack_eliciting = 1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int cc_replay_packet_end(void* ptr)
+{
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)ptr;
+    int ret = 0;
+
+    if (ctx->is_1rtt) {
+        if (ctx->rxtx) {
+            ret = cc_replay_process_acks(ctx, ctx->packet_time);
+        }
+        else {
+            cc_replay_path_t* r_path = cc_replay_get_path(ctx, ctx->packet_path_id, ctx->packet_time);
+            if (r_path != NULL) {
+                ret = cc_replay_add_packet(ctx, r_path);
+            }
+        }
+    }
+    ctx->is_1rtt = 0;
+
+    return ret;
+}
+
+static int cc_replay_packet_lost(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
+{
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)ptr;
+    int ret = 0;
+    uint64_t packet_type = 0;
+    uint64_t sequence = 0;
+    char trigger[32];
+    cc_replay_path_t* r_path = NULL;
+    cc_replay_packet_t* packet = NULL;
+
+    trigger[0] = 0;
+    ret |= byteread_vint(s, &packet_type);
+    ret |= byteread_vint(s, &sequence);
+    (void)byteread_cstr(s, trigger, sizeof(trigger));
+
+    if (ret == 0 && (packet_type == picoquic_packet_1rtt_protected || packet_type == picoquic_packet_0rtt_protected)) {
+        r_path = cc_replay_get_path(ctx, path_id, time);
+    }
+    if (r_path != NULL) {
+        packet = cc_replay_find_packet(r_path, sequence);
+    }
+    ret = 0;
+
+    if (packet != NULL && !packet->is_done) {
+        picoquic_path_t* path_x = r_path->path_x;
+        int is_timer = (strcmp(trigger, "timer") == 0);
+        picoquic_per_ack_state_t ack_state = { 0 };
+
+        ctx->simulated_time = time;
+        cc_replay_remove_in_transit(path_x, packet);
+        path_x->nb_losses_found++;
+        /* Same filter as picoquic_count_and_notify_loss */
+        if ((path_x->smoothed_rtt != PICOQUIC_INITIAL_RTT || path_x->rtt_variant != 0) &&
+            packet->send_time > ctx->cnx->start_time + path_x->smoothed_rtt) {
+            path_x->total_bytes_lost += packet->length;
+        }
+        ack_state.lost_packet_number = packet->sequence;
+        ack_state.lost_packet_sent_time = packet->send_time;
+        ack_state.nb_bytes_newly_lost = packet->length;
+        ctx->alg->alg_notify(ctx->cnx, path_x,
+            (is_timer) ? picoquic_congestion_notification_timeout : picoquic_congestion_notification_repeat,
+            &ack_state, time);
+        ctx->stats.nb_losses++;
+        ctx->stats.bytes_lost += packet->length;
+        ret = cc_replay_write_row(ctx, r_path, (is_timer) ? "timeout" : "loss", packet->length, time);
+        cc_replay_prune_packets(r_path);
+    }
+
+    return ret;
+}
+
+/* Keep track of the window computed by the recorded stack */
+static int cc_replay_cc_update(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
+{
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)ptr;
+    uint64_t sequence = 0;
+    uint64_t packet_rcvd = 0;
+    uint64_t skipped = 0;
+    uint64_t cwin = 0;
+    int ret = 0;
+
+    ret |= byteread_vint(s, &sequence);
+    ret |= byteread_vint(s, &packet_rcvd);
+    if (packet_rcvd != 0) {
+        ret |= byteread_vint(s, &skipped);
+        ret |= byteread_vint(s, &skipped);
+        ret |= byteread_vint(s, &skipped);
+    }
+    ret |= byteread_vint(s, &cwin);
+
+    if (ret == 0) {
+        cc_replay_path_t* r_path = cc_replay_get_path(ctx, path_id, time);
+        if (r_path != NULL) {
+            r_path->logged_cwin = cwin;
+        }
+    }
+
+    return 0;
+}
+
+static int cc_replay_connection_end(uint64_t time, void* ptr)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(time);
+    UNREFERENCED_PARAMETER(ptr);
+#endif
+    return 0;
+}
+
+int picoquic_cc_replay(FILE* f_binlog, const picoquic_connection_id_t* cid,
+    picoquic_congestion_algorithm_t const* alg, char const* option_string,
+    FILE* f_csv, picoquic_cc_replay_stats_t* stats)
+{
+    int ret = 0;
+    cc_replay_ctx_t* ctx = (cc_replay_ctx_t*)malloc(sizeof(cc_replay_ctx_t));
+
+    if (ctx == NULL || alg == NULL) {
+        ret = -1;
+    }
+    else {
+        binlog_convert_cb_t callbacks;
+
+        memset(ctx, 0, sizeof(cc_replay_ctx_t));
+        ctx->alg = alg;
+        ctx->option_string = option_string;
+        ctx->f_csv = f_csv;
+
+        memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.connection_start = cc_replay_connection_start;
+        callbacks.alpn_update = cc_replay_ignore_stream;
+        callbacks.param_update = cc_replay_ignore_stream;
+        callbacks.pdu = cc_replay_pdu;
+        callbacks.packet_start = cc_replay_packet_start;
+        callbacks.packet_frame = cc_replay_packet_frame;
+        callbacks.packet_end = cc_replay_packet_end;
+        callbacks.packet_lost = cc_replay_packet_lost;
+        callbacks.packet_dropped = cc_replay_ignore_path_stream;
+        callbacks.packet_buffered = cc_replay_ignore_path_stream;
+        callbacks.cc_update = cc_replay_cc_update;
+        callbacks.info_message = cc_replay_ignore_stream;
+        callbacks.connection_end = cc_replay_connection_end;
+        callbacks.ptr = ctx;
+
+        if (f_csv != NULL && fprintf(f_csv, "time, path, event, bytes, rtt sample, SRTT, RTT min, bandwidth (B/s), transit, cwin, pacing rate (B/s), pacing packet time(us), cc_state, cc_param, logged cwin\n") <= 0) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = binlog_convert(f_binlog, cid, &callbacks);
+        }
+        if (ret == 0 && stats != NULL) {
+            *stats = ctx->stats;
+        }
+
+        for (int i = 0; i < ctx->nb_paths; i++) {
+            if (ctx->paths[i].packets != NULL) {
+                free(ctx->paths[i].packets);
+            }
+        }
+        if (ctx->cnx != NULL) {
+            picoquic_delete_cnx(ctx->cnx);
+        }
+        if (ctx->quic != NULL) {
+            picoquic_free(ctx->quic);
+        }
+    }
+
+    if (ctx != NULL) {
+        free(ctx);
+    }
+
+    return ret;
+}
+
+int picoquic_cc_replay_file(char const* bin_log_name, const picoquic_connection_id_t* cid,
+    picoquic_congestion_algorithm_t const* alg, char const* option_string,
+    char const* csv_name, picoquic_cc_replay_stats_t* stats)
+{
+    int ret = 0;
+    uint64_t log_time = 0;
+    uint16_t flags = 0;
+    FILE* f_binlog = picoquic_open_cc_log_file_for_read(bin_log_name, &flags, &log_time);
+    FILE* f_csv = picoquic_file_open(csv_name, "w");
+
+    if (f_binlog == NULL || f_csv == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = picoquic_cc_replay(f_binlog, cid, alg, option_string, f_csv, stats);
+    }
+    (void)picoquic_file_close(f_csv);
+    (void)picoquic_file_close(f_binlog);
+
+    return ret;
+}
@@ -0,0 +1,67 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CC_REPLAY_H
+#define CC_REPLAY_H
+
+#include <stdio.h>
+#include "picoquic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Statistics collected while replaying a binary log. */
+typedef struct st_picoquic_cc_replay_stats_t {
+    uint64_t nb_packets_sent;
+    uint64_t nb_acks;
+    uint64_t nb_losses;
+    uint64_t bytes_acked;
+    uint64_t bytes_lost;
+    uint64_t cwin_max;
+    uint64_t nb_rows;
+} picoquic_cc_replay_stats_t;
+
+/*! \brief Replay the acknowledgements and losses of one connection through a
+ *         congestion control algorithm, and write the resulting congestion
+ *         window and pacing decisions as CSV.
+ *
+ *  \param f_binlog      The opened binary log file.
+ *  \param cid           Initial connection id of the connection to replay.
+ *  \param alg           Congestion control algorithm used for the replay.
+ *  \param option_string Option string passed to the algorithm, may be NULL.
+ *  \param f_csv         Output file, one line per ACK or loss event.
+ *  \param stats         If not NULL, receives the replay statistics.
+ */
+int picoquic_cc_replay(FILE* f_binlog, const picoquic_connection_id_t* cid,
+    picoquic_congestion_algorithm_t const* alg, char const* option_string,
+    FILE* f_csv, picoquic_cc_replay_stats_t* stats);
+
+/*! \brief Same as picoquic_cc_replay, opening the binary log and the CSV file by name. */
+int picoquic_cc_replay_file(char const* bin_log_name, const picoquic_connection_id_t* cid,
+    picoquic_congestion_algorithm_t const* alg, char const* option_string,
+    char const* csv_name, picoquic_cc_replay_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CC_REPLAY_H */
@@ -56,8 +56,7 @@ int picoquic_cc_log_file_to_csv(char const* bin_cc_log_name, char const* csv_cc_
     return ret;
 }
 
-/* Extract all picoquic_log_event_cc_update events from the binary log file and write them into an csv file. */
-int picoquic_cc_bin_to_csv(FILE * f_binlog, FILE * f_csvlog)
+static int picoquic_cc_csv_header(FILE* f_csvlog)
 {
     int ret = 0;
 
@@ -88,6 +87,14 @@ int picoquic_cc_bin_to_csv(FILE * f_binlog, FILE * f_csvlog)
     ret |= fprintf(f_csvlog, "transit, ") <= 0;
     ret |= fprintf(f_csvlog, "\n") <= 0;
 
+    return ret;
+}
+
+/* Extract all picoquic_log_event_cc_update events from the binary log file and write them into an csv file. */
+int picoquic_cc_bin_to_csv(FILE * f_binlog, FILE * f_csvlog)
+{
+    int ret = picoquic_cc_csv_header(f_csvlog);
+
     if (ret == 0) {
 
         csv_cb_data data;
@@ -101,6 +108,64 @@ int picoquic_cc_bin_to_csv(FILE * f_binlog, FILE * f_csvlog)
     return ret;
 }
 
+/* Same, but only for the events of the specified connection, read from the index. */
+int picoquic_cc_bin_to_csv_indexed(const binlog_index_t* index, const picoquic_connection_id_t* cid, FILE* f_csvlog)
+{
+    int ret = picoquic_cc_csv_header(f_csvlog);
+
+    if (ret == 0) {
+        csv_cb_data data;
+        data.f = f_csvlog;
+        data.starttime = 0;
+        data.idx = 0;
+
+        ret = binlog_index_read(index, cid, csv_cb, &data);
+    }
+
+    return ret;
+}
+
+/* Decode the content of a picoquic_log_event_cc_update record, after the event header.
+ * The last five fields were added later, and are 0 in older logs. */
+int picoquic_cc_update_decode(bytestream* s, picoquic_cc_update_record_t* r)
+{
+    int ret = 0;
+    uint64_t packet_rcvd = 0;
+
+    memset(r, 0, sizeof(picoquic_cc_update_record_t));
+    r->highest_ack = UINT64_MAX;
+
+    ret |= byteread_vint(s, &r->sequence);
+    ret |= byteread_vint(s, &packet_rcvd);
+    if (packet_rcvd != 0) {
+        ret |= byteread_vint(s, &r->highest_ack);
+        ret |= byteread_vint(s, &r->high_ack_time);
+        ret |= byteread_vint(s, &r->last_time_ack);
+    }
+    ret |= byteread_vint(s, &r->cwin);
+    ret |= byteread_vint(s, &r->one_way_delay);
+    ret |= byteread_vint(s, &r->rtt_sample);
+    ret |= byteread_vint(s, &r->SRTT);
+    ret |= byteread_vint(s, &r->RTT_min);
+    ret |= byteread_vint(s, &r->bandwidth_estimate);
+    ret |= byteread_vint(s, &r->receive_rate_estimate);
+    ret |= byteread_vint(s, &r->Send_MTU);
+    ret |= byteread_vint(s, &r->pacing_packet_time);
+    ret |= byteread_vint(s, &r->nb_retrans);
+    ret |= byteread_vint(s, &r->nb_spurious);
+    ret |= byteread_vint(s, &r->cwin_blkd);
+    ret |= byteread_vint(s, &r->flow_blkd);
+    ret |= byteread_vint(s, &r->stream_blkd);
+
+    (void)byteread_vint(s, &r->cc_state);
+    (void)byteread_vint(s, &r->cc_param);
+    (void)byteread_vint(s, &r->bw_max);
+    (void)byteread_vint(s, &r->bytes_in_transit);
+    (void)byteread_vint(s, &r->app_limited);
+
+    return ret;
+}
+
 int csv_cb(bytestream * s, void * ptr)
 {
     csv_cb_data * data = (csv_cb_data*)ptr;
@@ -127,63 +192,14 @@ int csv_cb(bytestream * s, void * ptr)
     time -= data->starttime;
 
     if (ret == 0 && id == picoquic_log_event_cc_update) {
-        uint64_t sequence = 0;
-        uint64_t packet_rcvd = 0;
-        uint64_t highest_ack = UINT64_MAX;
-        uint64_t high_ack_time = 0;
-        uint64_t last_time_ack = 0;
-        uint64_t cwin = 0;
-        uint64_t one_way_delay = 0;
-        uint64_t rtt_sample = 0;
-        uint64_t SRTT = 0;
-        uint64_t RTT_min = 0;
-        uint64_t bandwidth_estimate = 0;
-        uint64_t receive_rate_estimate = 0;
-        uint64_t Send_MTU = 0;
-        uint64_t pacing_packet_time = 0;
-        uint64_t nb_retrans = 0;
-        uint64_t nb_spurious = 0;
-        uint64_t cwin_blkd = 0;
-        uint64_t flow_blkd = 0;
-        uint64_t stream_blkd = 0;
-        uint64_t cc_state = 0;
-        uint64_t cc_param = 0;
-        uint64_t bw_max = 0;
-        uint64_t bytes_in_transit = 0;
-        uint64_t app_limited = 0;
-
-        ret |= byteread_vint(s, &sequence);
-        ret |= byteread_vint(s, &packet_rcvd);
-        if (packet_rcvd != 0) {
-            ret |= byteread_vint(s, &highest_ack);
-            ret |= byteread_vint(s, &high_ack_time);
-            ret |= byteread_vint(s, &last_time_ack);
-        }
-        ret |= byteread_vint(s, &cwin);
-        ret |= byteread_vint(s, &one_way_delay);
-        ret |= byteread_vint(s, &rtt_sample);
-        ret |= byteread_vint(s, &SRTT);
-        ret |= byteread_vint(s, &RTT_min);
-        ret |= byteread_vint(s, &bandwidth_estimate);
-        ret |= byteread_vint(s, &receive_rate_estimate);
-        ret |= byteread_vint(s, &Send_MTU);
-        ret |= byteread_vint(s, &pacing_packet_time);
-        ret |= byteread_vint(s, &nb_retrans);
-        ret |= byteread_vint(s, &nb_spurious);
-        ret |= byteread_vint(s, &cwin_blkd);
-        ret |= byteread_vint(s, &flow_blkd);
-        ret |= byteread_vint(s, &stream_blkd);
-
-        (void)byteread_vint(s, &cc_state);
-        (void)byteread_vint(s, &cc_param);
-        (void)byteread_vint(s, &bw_max);
-        (void)byteread_vint(s, &bytes_in_transit);
-        (void)byteread_vint(s, &app_limited);
+        picoquic_cc_update_record_t r;
+
+        ret = picoquic_cc_update_decode(s, &r);
 
         if (ret != 0 || fprintf(f_csvlog, "%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRId64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ",", 
-            time, path_id, sequence, (int64_t)highest_ack, high_ack_time, last_time_ack,
-            cwin, one_way_delay, rtt_sample, SRTT, RTT_min, bandwidth_estimate, receive_rate_estimate, Send_MTU, pacing_packet_time,
-            nb_retrans, nb_spurious, cwin_blkd, flow_blkd, stream_blkd, app_limited, cc_state, cc_param, bw_max, bytes_in_transit) <= 0) {
+            time, path_id, r.sequence, (int64_t)r.highest_ack, r.high_ack_time, r.last_time_ack,
+            r.cwin, r.one_way_delay, r.rtt_sample, r.SRTT, r.RTT_min, r.bandwidth_estimate, r.receive_rate_estimate, r.Send_MTU, r.pacing_packet_time,
+            r.nb_retrans, r.nb_spurious, r.cwin_blkd, r.flow_blkd, r.stream_blkd, r.app_limited, r.cc_state, r.cc_param, r.bw_max, r.bytes_in_transit) <= 0) {
             ret = -1;
         }
         if (ret != 0 || fprintf(f_csvlog, "\n") <= 0) {
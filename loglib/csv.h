@@ -21,16 +21,52 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include "picoquic.h"
+#include "bytestream.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Content of a picoquic_log_event_cc_update record, shared by the csv and
+ * Arrow conversions. highest_ack is UINT64_MAX if no packet was acknowledged yet. */
+typedef struct st_picoquic_cc_update_record_t {
+    uint64_t sequence;
+    uint64_t highest_ack;
+    uint64_t high_ack_time;
+    uint64_t last_time_ack;
+    uint64_t cwin;
+    uint64_t one_way_delay;
+    uint64_t rtt_sample;
+    uint64_t SRTT;
+    uint64_t RTT_min;
+    uint64_t bandwidth_estimate;
+    uint64_t receive_rate_estimate;
+    uint64_t Send_MTU;
+    uint64_t pacing_packet_time;
+    uint64_t nb_retrans;
+    uint64_t nb_spurious;
+    uint64_t cwin_blkd;
+    uint64_t flow_blkd;
+    uint64_t stream_blkd;
+    uint64_t cc_state;
+    uint64_t cc_param;
+    uint64_t bw_max;
+    uint64_t bytes_in_transit;
+    uint64_t app_limited;
+} picoquic_cc_update_record_t;
+
+int picoquic_cc_update_decode(bytestream* s, picoquic_cc_update_record_t* r);
+
 FILE * picoquic_open_cc_log_file_for_read(char const * bin_cc_log_name, uint16_t * flags, uint64_t * log_time);
 
+struct st_binlog_index_t;
+
 /* Extract all picoquic_log_event_cc_update events from the binary log file and write them into an csv file. */
 int picoquic_cc_log_file_to_csv(char const* bin_cc_log_name, char const* csv_cc_log_name);
 int picoquic_cc_bin_to_csv(FILE * f_binlog, FILE * f_csvlog);
+/* Same as picoquic_cc_bin_to_csv, for the events of a single connection read from an index. */
+int picoquic_cc_bin_to_csv_indexed(const struct st_binlog_index_t* index, const picoquic_connection_id_t* cid, FILE* f_csvlog);
 
 #ifdef __cplusplus
 }
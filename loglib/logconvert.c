@@ -127,6 +127,8 @@ const char * ftype2str(picoquic_frame_type_enum_t ftype)
         return "path_cid_blocked";
     case picoquic_frame_type_observed_address_v4:
         return "observed_address_v4";
+    case picoquic_frame_type_fec_repair:
+        return "fec_repair";
     case picoquic_frame_type_observed_address_v6:
         return "observed_address_v6";
     default:
@@ -19,12 +19,22 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef _WINDOWS
+#include "wincompat.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
 
 #include "picoquic_internal.h"
+#include "picoquic_utils.h"
 #include "bytestream.h"
 #include "logreader.h"
 #include "picoquic_binlog.h"
@@ -32,11 +42,163 @@
 
 static int byteread_packet_header(bytestream * s, picoquic_packet_header * ph);
 
+/* Pass the chunks of a decompressed block to the callback. If cid is not
+ * NULL, only pass the events of that connection within the time range. */
+static int binlog_read_block_chunks(const uint8_t* raw, size_t raw_length, const picoquic_connection_id_t* cid,
+    uint64_t start_time, uint64_t end_time, int(*cb)(bytestream*, void*), void* cbptr)
+{
+    int ret = 0;
+    size_t offset = 0;
+
+    while (ret == 0 && offset + 4 <= raw_length) {
+        size_t len = (size_t)PICOPARSE_32(raw + offset);
+        bytestream stream;
+
+        if (len > BYTESTREAM_MAX_BUFFER_SIZE || len > raw_length - offset - 4) {
+            ret = -1;
+        }
+        else {
+            int is_selected = 1;
+
+            if (cid != NULL) {
+                bytestream* s = bytestream_ref_init(&stream, raw + offset + 4, len);
+                picoquic_connection_id_t event_cid;
+                uint64_t time = 0;
+
+                is_selected = byteread_cid(s, &event_cid) == 0 && byteread_vint(s, &time) == 0 &&
+                    picoquic_compare_connection_id(&event_cid, cid) == 0 && time >= start_time && time <= end_time;
+            }
+            if (is_selected) {
+                ret = cb(bytestream_ref_init(&stream, raw + offset + 4, len), cbptr);
+            }
+            offset += 4 + len;
+        }
+    }
+
+    return ret;
+}
+
+/* Read the compressed blocks of a version 2 file, see binlog_block.c */
+static int fileread_binlog_blocks(FILE* bin_log, int(*cb)(bytestream*, void*), void* cbptr)
+{
+    int ret = 0;
+    uint8_t head[4];
+    uint8_t* block = NULL;
+    size_t block_size = 0;
+    uint8_t* raw = NULL;
+    size_t raw_size = 0;
+
+    while (ret == 0 && fread(head, sizeof(head), 1, bin_log) > 0) {
+        size_t block_length = 4 + (size_t)PICOPARSE_32(head);
+        picoquic_binlog_block_header_t header;
+
+        if (block_length > 2 * PICOQUIC_BINLOG_BLOCK_RAW_MAX) {
+            ret = -1;
+        }
+        else if (block_length > block_size) {
+            free(block);
+            block_size = 0;
+            if ((block = (uint8_t*)malloc(block_length)) == NULL) {
+                ret = -1;
+            }
+            else {
+                block_size = block_length;
+            }
+        }
+        if (ret == 0) {
+            memcpy(block, head, sizeof(head));
+            if (fread(block + sizeof(head), block_length - sizeof(head), 1, bin_log) <= 0 ||
+                picoquic_binlog_block_parse(block, block_length, &header) != 0) {
+                ret = -1;
+            }
+        }
+        if (ret == 0 && header.raw_length > raw_size) {
+            free(raw);
+            raw_size = 0;
+            if ((raw = (uint8_t*)malloc(header.raw_length)) == NULL) {
+                ret = -1;
+            }
+            else {
+                raw_size = header.raw_length;
+            }
+        }
+        if (ret == 0 && (ret = picoquic_binlog_block_decode(&header, block, raw)) == 0) {
+            ret = binlog_read_block_chunks(raw, header.raw_length, NULL, 0, UINT64_MAX, cb, cbptr);
+        }
+    }
+
+    free(block);
+    free(raw);
+
+    return ret;
+}
+
+#ifndef _WINDOWS
+/* Pass the events of a mapped version 1 file to the callback, as views of
+ * the mapping. Same checks as when reading the file. */
+static int binlog_read_mapped_events(const uint8_t* data, size_t size, int(*cb)(bytestream*, void*), void* cbptr)
+{
+    int ret = 0;
+    size_t offset = 16;
+
+    while (ret == 0 && offset + 4 <= size) {
+        size_t len = (size_t)PICOPARSE_32(data + offset);
+        bytestream stream;
+
+        if (len > BYTESTREAM_MAX_BUFFER_SIZE || len > size - offset - 4) {
+            ret = -1;
+        }
+        else {
+            ret |= cb(bytestream_ref_init(&stream, data + offset + 4, len), cbptr);
+            offset += 4 + len;
+        }
+    }
+
+    return ret;
+}
+
+/* Map the file instead of copying each event. Returns -1 if the file cannot
+ * be mapped, e.g., if it is a pipe, in which case it is read as a stream. */
+static int fileread_binlog_mapped(FILE* bin_log, int(*cb)(bytestream*, void*), void* cbptr, int* ret_cb)
+{
+    int ret = -1;
+    struct stat st;
+    int fd = fileno(bin_log);
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= 16 && (uint64_t)st.st_size <= (uint64_t)SIZE_MAX) {
+        void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (base != MAP_FAILED) {
+            (void)madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+            *ret_cb = binlog_read_mapped_events((const uint8_t*)base, (size_t)st.st_size, cb, cbptr);
+            (void)munmap(base, (size_t)st.st_size);
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+#endif
+
 int fileread_binlog(FILE* bin_log, int(*cb)(bytestream*, void*), void* cbptr)
 {
     int ret = 0;
     uint8_t head[4];
     bytestream_buf stream_msg;
+    uint8_t file_header[16];
+
+    fseek(bin_log, 0, SEEK_SET);
+    if (fread(file_header, sizeof(file_header), 1, bin_log) > 0 &&
+        PICOPARSE_16(file_header + 6) == PICOQUIC_BINLOG_VERSION_BLOCKS) {
+        return fileread_binlog_blocks(bin_log, cb, cbptr);
+    }
+
+#ifndef _WINDOWS
+    if (fileread_binlog_mapped(bin_log, cb, cbptr, &ret) == 0) {
+        return ret;
+    }
+#endif
 
     fseek(bin_log, 16, SEEK_SET);
 
@@ -209,6 +371,18 @@ int binlog_convert(FILE * f_binlog, const picoquic_connection_id_t * cid, binlog
     return fileread_binlog(f_binlog, binlog_convert_event, &ctx);
 }
 
+int binlog_convert_record(const uint8_t* bytes, size_t length, const picoquic_connection_id_t* cid, binlog_convert_cb_t* callbacks)
+{
+    convert_log_file_event_t ctx;
+    bytestream stream;
+    bytestream* s = bytestream_ref_init(&stream, bytes, length);
+
+    ctx.cid = cid;
+    ctx.callbacks = callbacks;
+
+    return binlog_convert_event(s, &ctx);
+}
+
 static int binlog_list_cids_cb(bytestream * s, void * cbptr)
 {
     picoquic_connection_id_t cid;
@@ -321,7 +495,8 @@ FILE * picoquic_open_cc_log_file_for_read(char const * bin_cc_log_name, uint16_t
             ret = -1;
             DBG_PRINTF("Header for file %s does include flags.\n", bin_cc_log_name);
         }
-        else if (byteread_int16(ps, &version) != 0 || version != 0x01) {
+        else if (byteread_int16(ps, &version) != 0 ||
+            (version != PICOQUIC_BINLOG_VERSION && version != PICOQUIC_BINLOG_VERSION_BLOCKS)) {
             ret = -1;
             DBG_PRINTF("Header for file %s requires unsupported version.\n", bin_cc_log_name);
         }
@@ -336,3 +511,516 @@ FILE * picoquic_open_cc_log_file_for_read(char const * bin_cc_log_name, uint16_t
 
     return bin_log;
 }
+
+/*
+ * Indexed reading of binary logs.
+ *
+ * The log file is mapped in memory, and read once to build the list of
+ * connections and, for each connection, the offsets of its events. The
+ * conversion of a connection then only visits its own events, and the
+ * conversions of different connections can proceed in parallel, since the
+ * index is not modified after it is built.
+ */
+typedef struct st_binlog_index_cnx_t {
+    picoquic_connection_id_t cid; /* Must be first, used as hash key */
+    uint64_t* offsets;
+    size_t nb_events;
+    size_t nb_alloc;
+} binlog_index_cnx_t;
+
+struct st_binlog_index_t {
+    const uint8_t* data;
+    size_t size;
+    uint16_t version; /* For version 2, the offsets are those of the blocks */
+    picohash_table* table;
+    binlog_index_cnx_t** cnx;
+    size_t nb_cnx;
+    size_t nb_cnx_alloc;
+#ifdef _WINDOWS
+    HANDLE file_handle;
+    HANDLE map_handle;
+#endif
+};
+
+static uint64_t binlog_index_cid_hash(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_connection_id_t* cid = (const picoquic_connection_id_t*)key;
+    return picoquic_connection_id_hash(cid, hash_seed);
+}
+
+static int binlog_index_cid_compare(const void* key0, const void* key1)
+{
+    const picoquic_connection_id_t* cid0 = (const picoquic_connection_id_t*)key0;
+    const picoquic_connection_id_t* cid1 = (const picoquic_connection_id_t*)key1;
+
+    return picoquic_compare_connection_id(cid0, cid1);
+}
+
+static int binlog_index_map(binlog_index_t* index, char const* binlog_name)
+{
+    int ret = 0;
+#ifdef _WINDOWS
+    LARGE_INTEGER file_size;
+
+    index->file_handle = CreateFileA(binlog_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (index->file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(index->file_handle, &file_size)) {
+        ret = -1;
+    }
+    else if ((uint64_t)file_size.QuadPart < 16 || (uint64_t)file_size.QuadPart > (uint64_t)SIZE_MAX) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        index->size = (size_t)file_size.QuadPart;
+        index->map_handle = CreateFileMappingA(index->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (index->map_handle == NULL ||
+            (index->data = (const uint8_t*)MapViewOfFile(index->map_handle, FILE_MAP_READ, 0, 0, 0)) == NULL) {
+            ret = -1;
+        }
+    }
+#else
+    int fd = open(binlog_name, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        ret = -1;
+    }
+    else if (st.st_size < 16 || (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (base == MAP_FAILED) {
+            ret = -1;
+        }
+        else {
+            index->data = (const uint8_t*)base;
+            index->size = (size_t)st.st_size;
+            (void)madvise(base, index->size, MADV_SEQUENTIAL);
+        }
+    }
+    if (fd >= 0) {
+        /* The mapping remains valid after the file is closed */
+        (void)close(fd);
+    }
+#endif
+    return ret;
+}
+
+void binlog_index_close(binlog_index_t* index)
+{
+    if (index != NULL) {
+        for (size_t i = 0; i < index->nb_cnx; i++) {
+            free(index->cnx[i]->offsets);
+        }
+        free(index->cnx);
+        if (index->table != NULL) {
+            /* Also frees the connection entries, which are the hash keys */
+            picohash_delete(index->table, 1);
+        }
+#ifdef _WINDOWS
+        if (index->data != NULL) {
+            (void)UnmapViewOfFile(index->data);
+        }
+        if (index->map_handle != NULL) {
+            (void)CloseHandle(index->map_handle);
+        }
+        if (index->file_handle != INVALID_HANDLE_VALUE) {
+            (void)CloseHandle(index->file_handle);
+        }
+#else
+        if (index->data != NULL) {
+            (void)munmap((void*)index->data, index->size);
+        }
+#endif
+        free(index);
+    }
+}
+
+static binlog_index_cnx_t* binlog_index_get_cnx(binlog_index_t* index, const picoquic_connection_id_t* cid)
+{
+    picohash_item* item = picohash_retrieve(index->table, cid);
+    binlog_index_cnx_t* cnx = NULL;
+
+    if (item != NULL) {
+        cnx = (binlog_index_cnx_t*)item->key;
+    }
+    else {
+        if (index->nb_cnx >= index->nb_cnx_alloc) {
+            size_t new_alloc = 2 * index->nb_cnx_alloc + 16;
+            binlog_index_cnx_t** new_cnx = (binlog_index_cnx_t**)realloc(index->cnx, new_alloc * sizeof(binlog_index_cnx_t*));
+
+            if (new_cnx != NULL) {
+                index->cnx = new_cnx;
+                index->nb_cnx_alloc = new_alloc;
+            }
+        }
+        if (index->nb_cnx < index->nb_cnx_alloc &&
+            (cnx = (binlog_index_cnx_t*)malloc(sizeof(binlog_index_cnx_t))) != NULL) {
+            memset(cnx, 0, sizeof(binlog_index_cnx_t));
+            cnx->cid = *cid;
+            if (picohash_insert(index->table, cnx) != 0) {
+                free(cnx);
+                cnx = NULL;
+            }
+            else {
+                index->cnx[index->nb_cnx++] = cnx;
+            }
+        }
+    }
+
+    return cnx;
+}
+
+static int binlog_index_add_offset(binlog_index_t* index, const picoquic_connection_id_t* cid, size_t offset)
+{
+    int ret = 0;
+    binlog_index_cnx_t* cnx = binlog_index_get_cnx(index, cid);
+
+    if (cnx == NULL) {
+        ret = -1;
+    }
+    else if (cnx->nb_events == 0 || cnx->offsets[cnx->nb_events - 1] != offset) {
+        if (cnx->nb_events >= cnx->nb_alloc) {
+            size_t new_alloc = (cnx->nb_alloc == 0) ? 256 : 2 * cnx->nb_alloc;
+            uint64_t* new_offsets = (uint64_t*)realloc(cnx->offsets, new_alloc * sizeof(uint64_t));
+
+            if (new_offsets == NULL) {
+                ret = -1;
+            }
+            else {
+                cnx->offsets = new_offsets;
+                cnx->nb_alloc = new_alloc;
+            }
+        }
+        if (ret == 0) {
+            cnx->offsets[cnx->nb_events++] = offset;
+        }
+    }
+
+    return ret;
+}
+
+typedef struct st_binlog_index_block_scan_t {
+    binlog_index_t* index;
+    size_t offset;
+} binlog_index_block_scan_t;
+
+static int binlog_index_block_scan_cb(bytestream* s, void* ptr)
+{
+    binlog_index_block_scan_t* scan = (binlog_index_block_scan_t*)ptr;
+    picoquic_connection_id_t cid;
+    int ret = byteread_cid(s, &cid);
+
+    if (ret == 0) {
+        ret = binlog_index_add_offset(scan->index, &cid, scan->offset);
+    }
+
+    return ret;
+}
+
+/* Version 2: only read the block headers, except for the blocks that
+ * have too many connections to list them. */
+static int binlog_index_build_blocks(binlog_index_t* index)
+{
+    int ret = 0;
+    size_t offset = 16;
+    uint8_t* raw = NULL;
+
+    while (ret == 0 && offset + 4 <= index->size) {
+        picoquic_binlog_block_header_t header;
+
+        if (picoquic_binlog_block_parse(index->data + offset, index->size - offset, &header) != 0) {
+            ret = -1;
+        }
+        else if (header.is_cid_list_overflow) {
+            binlog_index_block_scan_t scan;
+
+            scan.index = index;
+            scan.offset = offset;
+            if ((raw = (uint8_t*)malloc((header.raw_length > 0) ? header.raw_length : 1)) == NULL ||
+                picoquic_binlog_block_decode(&header, index->data + offset, raw) != 0) {
+                ret = -1;
+            }
+            else {
+                ret = binlog_read_block_chunks(raw, header.raw_length, NULL, 0, UINT64_MAX, binlog_index_block_scan_cb, &scan);
+            }
+            free(raw);
+            raw = NULL;
+        }
+        else {
+            for (size_t i = 0; ret == 0 && i < header.nb_cids; i++) {
+                ret = binlog_index_add_offset(index, &header.cid[i], offset);
+            }
+        }
+        offset += header.block_length;
+    }
+
+    return ret;
+}
+
+/* Single pass over the file, recording the offset of each event.
+ * Same checks as in fileread_binlog. */
+static int binlog_index_build(binlog_index_t* index)
+{
+    int ret = 0;
+    size_t offset = 16;
+
+    while (ret == 0 && offset + 4 <= index->size) {
+        size_t len = (size_t)PICOPARSE_32(index->data + offset);
+        picoquic_connection_id_t cid;
+        bytestream stream;
+
+        if (len > BYTESTREAM_MAX_BUFFER_SIZE || len > index->size - offset - 4 ||
+            byteread_cid(bytestream_ref_init(&stream, index->data + offset + 4, len), &cid) != 0 ||
+            binlog_index_add_offset(index, &cid, offset) != 0) {
+            ret = -1;
+        }
+        else {
+            offset += 4 + len;
+        }
+    }
+
+    return ret;
+}
+
+binlog_index_t* binlog_index_open(char const* binlog_name, uint16_t* flags, uint64_t* log_time)
+{
+    binlog_index_t* index = (binlog_index_t*)malloc(sizeof(binlog_index_t));
+    int ret = 0;
+
+    if (index == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(index, 0, sizeof(binlog_index_t));
+#ifdef _WINDOWS
+        index->file_handle = INVALID_HANDLE_VALUE;
+#endif
+        if ((ret = binlog_index_map(index, binlog_name)) != 0) {
+            DBG_PRINTF("Cannot map log file %s.\n", binlog_name);
+        }
+    }
+
+    if (ret == 0) {
+        bytestream stream;
+        bytestream* ps = bytestream_ref_init(&stream, index->data, 16);
+        uint32_t fcc = 0;
+        uint16_t version = 0;
+
+        if (byteread_int32(ps, &fcc) != 0 || fcc != FOURCC('q', 'l', 'o', 'g') ||
+            byteread_int16(ps, flags) != 0 || byteread_int16(ps, &version) != 0 ||
+            (version != PICOQUIC_BINLOG_VERSION && version != PICOQUIC_BINLOG_VERSION_BLOCKS) ||
+            byteread_int64(ps, log_time) != 0) {
+            DBG_PRINTF("Log file %s does not have a valid header.\n", binlog_name);
+            ret = -1;
+        }
+        else {
+            index->version = version;
+        }
+    }
+
+    if (ret == 0) {
+        /* Size the hash table for a few events per kilobyte */
+        size_t nb_bin = index->size / 4096;
+
+        if ((index->table = picohash_create((nb_bin < 32) ? 32 : ((nb_bin > 0x100000) ? 0x100000 : nb_bin),
+            binlog_index_cid_hash, binlog_index_cid_compare)) == NULL) {
+            ret = -1;
+        }
+        else if (index->version == PICOQUIC_BINLOG_VERSION_BLOCKS) {
+            ret = binlog_index_build_blocks(index);
+        }
+        else {
+            ret = binlog_index_build(index);
+        }
+    }
+
+    if (ret != 0 && index != NULL) {
+        binlog_index_close(index);
+        index = NULL;
+    }
+
+    return index;
+}
+
+size_t binlog_index_nb_cids(const binlog_index_t* index)
+{
+    return index->nb_cnx;
+}
+
+const picoquic_connection_id_t* binlog_index_cid(const binlog_index_t* index, size_t rank)
+{
+    return (rank < index->nb_cnx) ? &index->cnx[rank]->cid : NULL;
+}
+
+/* Version 2: decompress the blocks of the connection that overlap the time range */
+static int binlog_index_read_blocks(const binlog_index_t* index, const binlog_index_cnx_t* cnx,
+    uint64_t start_time, uint64_t end_time, int(*cb)(bytestream*, void*), void* cbptr)
+{
+    int ret = 0;
+    uint8_t* raw = NULL;
+    size_t raw_size = 0;
+
+    for (size_t i = 0; ret == 0 && i < cnx->nb_events; i++) {
+        const uint8_t* block = index->data + cnx->offsets[i];
+        picoquic_binlog_block_header_t header;
+
+        if (picoquic_binlog_block_parse(block, index->size - (size_t)cnx->offsets[i], &header) != 0) {
+            ret = -1;
+        }
+        else if (header.last_time < start_time || header.first_time > end_time) {
+            continue;
+        }
+        else if (header.raw_length > raw_size) {
+            free(raw);
+            raw_size = 0;
+            if ((raw = (uint8_t*)malloc(header.raw_length)) == NULL) {
+                ret = -1;
+            }
+            else {
+                raw_size = header.raw_length;
+            }
+        }
+        if (ret == 0 && (ret = picoquic_binlog_block_decode(&header, block, raw)) == 0) {
+            ret = binlog_read_block_chunks(raw, header.raw_length, &cnx->cid, start_time, end_time, cb, cbptr);
+        }
+    }
+
+    free(raw);
+
+    return ret;
+}
+
+int binlog_index_read_range(const binlog_index_t* index, const picoquic_connection_id_t* cid,
+    uint64_t start_time, uint64_t end_time, int(*cb)(bytestream*, void*), void* cbptr)
+{
+    int ret = 0;
+    picohash_item* item = picohash_retrieve(index->table, cid);
+
+    if (item != NULL) {
+        binlog_index_cnx_t* cnx = (binlog_index_cnx_t*)item->key;
+
+        if (index->version == PICOQUIC_BINLOG_VERSION_BLOCKS) {
+            ret = binlog_index_read_blocks(index, cnx, start_time, end_time, cb, cbptr);
+        }
+        else {
+            for (size_t i = 0; ret == 0 && i < cnx->nb_events; i++) {
+                const uint8_t* chunk = index->data + cnx->offsets[i];
+                bytestream stream;
+                bytestream* s = bytestream_ref_init(&stream, chunk + 4, (size_t)PICOPARSE_32(chunk));
+
+                if (start_time > 0 || end_time < UINT64_MAX) {
+                    picoquic_connection_id_t event_cid;
+                    uint64_t time = 0;
+
+                    if (byteread_cid(s, &event_cid) != 0 || byteread_vint(s, &time) != 0 ||
+                        time < start_time || time > end_time) {
+                        continue;
+                    }
+                    s = bytestream_ref_init(&stream, chunk + 4, (size_t)PICOPARSE_32(chunk));
+                }
+                ret = cb(s, cbptr);
+            }
+        }
+    }
+
+    return ret;
+}
+
+int binlog_index_read(const binlog_index_t* index, const picoquic_connection_id_t* cid, int(*cb)(bytestream*, void*), void* cbptr)
+{
+    return binlog_index_read_range(index, cid, 0, UINT64_MAX, cb, cbptr);
+}
+
+int binlog_index_convert(const binlog_index_t* index, const picoquic_connection_id_t* cid, binlog_convert_cb_t* callbacks)
+{
+    convert_log_file_event_t ctx;
+    ctx.cid = cid;
+    ctx.callbacks = callbacks;
+
+    return binlog_index_read(index, cid, binlog_convert_event, &ctx);
+}
+
+/* Conversion of all connections by a pool of threads */
+typedef struct st_binlog_index_pool_t {
+    const binlog_index_t* index;
+    int (*cb)(const picoquic_connection_id_t*, void*);
+    void* cbptr;
+    picoquic_mutex_t mutex;
+    size_t next_rank;
+    int ret;
+} binlog_index_pool_t;
+
+static picoquic_thread_return_t binlog_index_pool_worker(void* v_pool)
+{
+    binlog_index_pool_t* pool = (binlog_index_pool_t*)v_pool;
+
+    while (1) {
+        size_t rank;
+        int ret;
+
+        picoquic_lock_mutex(&pool->mutex);
+        rank = pool->next_rank++;
+        picoquic_unlock_mutex(&pool->mutex);
+
+        if (rank >= pool->index->nb_cnx) {
+            break;
+        }
+        ret = pool->cb(&pool->index->cnx[rank]->cid, pool->cbptr);
+        if (ret != 0) {
+            picoquic_lock_mutex(&pool->mutex);
+            pool->ret = ret;
+            picoquic_unlock_mutex(&pool->mutex);
+        }
+    }
+
+    picoquic_thread_do_return;
+}
+
+int binlog_index_iterate(const binlog_index_t* index, int nb_threads, int(*cb)(const picoquic_connection_id_t*, void*), void* cbptr)
+{
+    int ret = 0;
+
+    if (nb_threads <= 1 || index->nb_cnx <= 1) {
+        for (size_t i = 0; ret == 0 && i < index->nb_cnx; i++) {
+            ret = cb(&index->cnx[i]->cid, cbptr);
+        }
+    }
+    else {
+        binlog_index_pool_t pool;
+        picoquic_thread_t* threads;
+        int nb_started = 0;
+
+        if ((size_t)nb_threads > index->nb_cnx) {
+            nb_threads = (int)index->nb_cnx;
+        }
+        memset(&pool, 0, sizeof(pool));
+        pool.index = index;
+        pool.cb = cb;
+        pool.cbptr = cbptr;
+
+        if ((threads = (picoquic_thread_t*)malloc(nb_threads * sizeof(picoquic_thread_t))) == NULL ||
+            picoquic_create_mutex(&pool.mutex) != 0) {
+            free(threads);
+            return -1;
+        }
+        while (nb_started < nb_threads && picoquic_create_thread(&threads[nb_started], binlog_index_pool_worker, &pool) == 0) {
+            nb_started++;
+        }
+        if (nb_started == 0) {
+            /* No thread could be started; convert on the calling thread */
+            (void)binlog_index_pool_worker(&pool);
+        }
+        for (int i = 0; i < nb_started; i++) {
+            (void)picoquic_wait_thread(threads[i]);
+            picoquic_delete_thread(&threads[i]);
+        }
+        (void)picoquic_delete_mutex(&pool.mutex);
+        free(threads);
+        ret = pool.ret;
+    }
+
+    return ret;
+}
@@ -77,6 +77,16 @@ typedef struct binlog_convert_cb_st {
  */
 int binlog_convert(FILE * f_binlog, const picoquic_connection_id_t * cid, binlog_convert_cb_t * callbacks);
 
+/*! \brief Same as binlog_convert, for a single record passed in memory,
+ *         e.g., when converting the records as they are produced.
+ *
+ *  \param bytes     The record, without the length prefix.
+ *  \param length    Length of the record.
+ *  \param cid       Initial connection id for the events to be called back.
+ *  \param callbacks Callback functions for the events.
+ */
+int binlog_convert_record(const uint8_t* bytes, size_t length, const picoquic_connection_id_t* cid, binlog_convert_cb_t* callbacks);
+
 /*! \brief Write all connection ids contained in a binary log file into a
  *         picohash_table.
  *
@@ -104,6 +114,52 @@ FILE * open_outfile(const char * cid_name, const char * binlog_name, const char
 
 FILE * picoquic_open_cc_log_file_for_read(char const * bin_cc_log_name, uint16_t * flags, uint64_t * log_time);
 
+/*! \brief Index of the events of a binary log file, per connection.
+ *
+ *  The file is mapped in memory and read once when the index is opened.
+ *  After that, the events of each connection can be read without scanning
+ *  the whole file, and connections can be converted in parallel since the
+ *  index is never modified.
+ */
+typedef struct st_binlog_index_t binlog_index_t;
+
+/*! \brief Map a binary log file and index its events per connection.
+ *
+ *  \param binlog_name Name of the binary log file.
+ *  \param flags       Receives the flags found in the file header.
+ *  \param log_time    Receives the log time found in the file header.
+ *
+ *  \return The index, or NULL if the file cannot be mapped or is not valid.
+ */
+binlog_index_t* binlog_index_open(char const* binlog_name, uint16_t* flags, uint64_t* log_time);
+
+/*! \brief Release the index and unmap the file. */
+void binlog_index_close(binlog_index_t* index);
+
+/*! \brief Number of connections in the index, and connection id by rank,
+ *         in the order of their first event in the file. */
+size_t binlog_index_nb_cids(const binlog_index_t* index);
+const picoquic_connection_id_t* binlog_index_cid(const binlog_index_t* index, size_t rank);
+
+/*! \brief Same as fileread_binlog, for the events of a single connection. */
+int binlog_index_read(const binlog_index_t* index, const picoquic_connection_id_t* cid, int(*cb)(bytestream*, void*), void* cbptr);
+
+/*! \brief Same as binlog_index_read, only for the events whose time is
+ *         between start_time and end_time, both included. In compressed
+ *         files, blocks outside of the range are not decompressed.
+ */
+int binlog_index_read_range(const binlog_index_t* index, const picoquic_connection_id_t* cid,
+    uint64_t start_time, uint64_t end_time, int(*cb)(bytestream*, void*), void* cbptr);
+
+/*! \brief Same as binlog_convert, using the index. */
+int binlog_index_convert(const binlog_index_t* index, const picoquic_connection_id_t* cid, binlog_convert_cb_t* callbacks);
+
+/*! \brief Call cb for each connection in the index, using nb_threads
+ *         threads if larger than 1. The callback must then be thread safe.
+ *         Returns a non zero error code if any of the calls failed.
+ */
+int binlog_index_iterate(const binlog_index_t* index, int nb_threads, int(*cb)(const picoquic_connection_id_t*, void*), void* cbptr);
+
 int picoquic_cc_log_file_to_csv(char const * bin_cc_log_name, char const * csv_cc_log_name);
 
 #ifdef __cplusplus
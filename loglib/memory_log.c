@@ -33,6 +33,13 @@
 * - log memory callback function.
 * - log memory address.
 * There are two callbacks: log PDU, and close.
+*
+* The ring mode keeps the lines of all the connections of a QUIC context
+* in a single table, allocated when the ring is created. When the table is
+* full, the new lines replace the oldest ones, so the log can stay on for
+* all connections within a fixed memory budget. The lines are saved as
+* binary records when the context is freed, or on demand, and converted
+* to CSV offline with memlog_ring_to_csv.
 */
 #include <stdint.h>
 #include <stdio.h>
@@ -283,4 +290,213 @@ int memlog_init(picoquic_cnx_t* cnx, size_t nb_lines, const char * memlog_file)
         }
     }
     return(ret);
-}
\ No newline at end of file
+}
+/* Ring mode. Each record carries the identification of the connection.
+ * The records are saved in the host byte order, and the file header
+ * records their size, so that mismatched files can be rejected. */
+#define MEMLOG_RING_VERSION 1
+#define MEMLOG_RING_HEADER_SIZE 32
+#define MEMLOG_RING_NB_SLOTS 1024
+
+typedef struct st_picoquic_memory_record_t {
+    picoquic_connection_id_t initial_cnxid;
+    uint64_t unique_path_id;
+    uint64_t start_time;
+    picoquic_memory_line_t line;
+} picoquic_memory_record_t;
+
+typedef struct st_picoquic_memory_ring_t {
+    char* file_name;
+    size_t nb_records;
+    uint64_t nb_written;
+    /* Number + 1 of the last record of the connections whose initial CID
+     * hashes to the slot, used to suppress duplicate lines */
+    uint64_t last_record[MEMLOG_RING_NB_SLOTS];
+    picoquic_memory_record_t* records;
+} picoquic_memory_ring_t;
+
+static picoquic_memory_record_t* memlog_ring_previous(picoquic_memory_ring_t* ring, picoquic_cnx_t* cnx, size_t slot)
+{
+    picoquic_memory_record_t* previous = NULL;
+    uint64_t number = ring->last_record[slot];
+
+    if (number > 0 && number + ring->nb_records > ring->nb_written) {
+        previous = &ring->records[(number - 1) % ring->nb_records];
+        if (picoquic_compare_connection_id(&previous->initial_cnxid, &cnx->initial_cnxid) != 0) {
+            previous = NULL;
+        }
+    }
+
+    return previous;
+}
+
+static int memlog_ring_write(picoquic_memory_ring_t* ring, FILE* F)
+{
+    int ret = 0;
+    uint8_t header[MEMLOG_RING_HEADER_SIZE];
+    uint64_t nb_saved = (ring->nb_written < ring->nb_records) ? ring->nb_written : ring->nb_records;
+    uint64_t first = ring->nb_written - nb_saved;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "mlog", 4);
+    picoformat_32(header + 4, MEMLOG_RING_VERSION);
+    picoformat_32(header + 8, (uint32_t)sizeof(picoquic_memory_record_t));
+    picoformat_64(header + 16, ring->nb_written);
+    picoformat_64(header + 24, nb_saved);
+
+    if (fwrite(header, sizeof(header), 1, F) != 1) {
+        ret = -1;
+    }
+    else if (nb_saved > 0) {
+        /* Oldest records first, in at most two pieces */
+        size_t start = (size_t)(first % ring->nb_records);
+        size_t first_piece = ring->nb_records - start;
+
+        if (first_piece > nb_saved) {
+            first_piece = (size_t)nb_saved;
+        }
+        if (fwrite(&ring->records[start], sizeof(picoquic_memory_record_t), first_piece, F) != first_piece ||
+            (nb_saved > first_piece &&
+                fwrite(ring->records, sizeof(picoquic_memory_record_t), (size_t)nb_saved - first_piece, F) !=
+                (size_t)nb_saved - first_piece)) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int memlog_ring_save(picoquic_quic_t* quic, const char* memlog_bin_file)
+{
+    int ret = -1;
+    picoquic_memory_ring_t* ring = (picoquic_memory_ring_t*)quic->memlog_ctx;
+
+    if (ring != NULL) {
+        FILE* F = picoquic_file_open(memlog_bin_file, "wb");
+
+        if (F != NULL) {
+            ret = memlog_ring_write(ring, F);
+            (void)picoquic_file_close(F);
+        }
+    }
+
+    return ret;
+}
+
+void memlog_ring_call_back(picoquic_cnx_t* cnx, picoquic_path_t* path, void* v_memlog, int op_code, uint64_t current_time)
+{
+    picoquic_memory_ring_t* ring = (picoquic_memory_ring_t*)v_memlog;
+
+    if (ring == NULL) {
+        return;
+    }
+
+    if (op_code == 0) {
+        size_t slot = (size_t)(picoquic_connection_id_hash(&cnx->initial_cnxid, cnx->quic->hash_seed) % MEMLOG_RING_NB_SLOTS);
+        picoquic_memory_record_t* previous = memlog_ring_previous(ring, cnx, slot);
+        picoquic_memory_line_t line;
+
+        /* The line is filled aside, because the ring slot holds the oldest record */
+        if (memlog_fill_line(cnx, path, &line, (previous == NULL) ? NULL : &previous->line, current_time) == 0) {
+            picoquic_memory_record_t* record = &ring->records[ring->nb_written % ring->nb_records];
+
+            record->initial_cnxid = cnx->initial_cnxid;
+            record->unique_path_id = path->unique_path_id;
+            record->start_time = cnx->start_time;
+            record->line = line;
+            ring->nb_written++;
+            ring->last_record[slot] = ring->nb_written;
+        }
+    }
+    else if (cnx == NULL) {
+        /* The QUIC context is being freed */
+        if (ring->file_name != NULL) {
+            FILE* F = picoquic_file_open(ring->file_name, "wb");
+
+            if (F != NULL) {
+                (void)memlog_ring_write(ring, F);
+                (void)picoquic_file_close(F);
+            }
+            free(ring->file_name);
+        }
+        free(ring->records);
+        free(ring);
+    }
+}
+
+int memlog_ring_init(picoquic_quic_t* quic, size_t memory_budget, const char* memlog_bin_file)
+{
+    int ret = -1;
+    size_t nb_records = (memory_budget > sizeof(picoquic_memory_ring_t)) ?
+        (memory_budget - sizeof(picoquic_memory_ring_t)) / sizeof(picoquic_memory_record_t) : 0;
+    picoquic_memory_ring_t* ring = NULL;
+
+    if (quic->memlog_call_back == NULL && nb_records > 0 &&
+        (ring = (picoquic_memory_ring_t*)malloc(sizeof(picoquic_memory_ring_t))) != NULL) {
+        memset(ring, 0, sizeof(picoquic_memory_ring_t));
+        ring->nb_records = nb_records;
+        if ((ring->records = (picoquic_memory_record_t*)malloc(nb_records * sizeof(picoquic_memory_record_t))) != NULL &&
+            (memlog_bin_file == NULL || (ring->file_name = picoquic_string_duplicate(memlog_bin_file)) != NULL)) {
+            quic->memlog_call_back = memlog_ring_call_back;
+            quic->memlog_ctx = ring;
+            ret = 0;
+        }
+        else {
+            free(ring->records);
+            free(ring);
+        }
+    }
+
+    return ret;
+}
+
+int memlog_ring_to_csv(const char* memlog_bin_file, const char* csv_file, const picoquic_connection_id_t* cid)
+{
+    int ret = 0;
+    FILE* F_bin = picoquic_file_open(memlog_bin_file, "rb");
+    FILE* F_csv = NULL;
+    uint8_t header[MEMLOG_RING_HEADER_SIZE];
+    uint64_t nb_saved = 0;
+
+    if (F_bin == NULL) {
+        ret = -1;
+    }
+    else if (fread(header, sizeof(header), 1, F_bin) != 1 || memcmp(header, "mlog", 4) != 0 ||
+        PICOPARSE_32(header + 4) != MEMLOG_RING_VERSION ||
+        PICOPARSE_32(header + 8) != (uint32_t)sizeof(picoquic_memory_record_t)) {
+        DBG_PRINTF("File %s is not a memory log ring", memlog_bin_file);
+        ret = -1;
+    }
+    else if ((F_csv = picoquic_file_open(csv_file, "wt")) == NULL) {
+        ret = -1;
+    }
+    else {
+        nb_saved = PICOPARSE_64(header + 24);
+        fprintf(F_csv, "cnx_id, path_id, start_time, ");
+        memlog_print_header(F_csv);
+
+        for (uint64_t i = 0; ret == 0 && i < nb_saved; i++) {
+            picoquic_memory_record_t record;
+
+            if (fread(&record, sizeof(record), 1, F_bin) != 1) {
+                ret = -1;
+            }
+            else if (cid == NULL || picoquic_compare_connection_id(cid, &record.initial_cnxid) == 0) {
+                char cid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
+
+                if (picoquic_print_connection_id_hexa(cid_name, sizeof(cid_name), &record.initial_cnxid) != 0) {
+                    ret = -1;
+                }
+                else {
+                    fprintf(F_csv, "%s,%" PRIu64 ",%" PRIu64 ",", cid_name, record.unique_path_id, record.start_time);
+                    memlog_print_line(F_csv, &record.line);
+                }
+            }
+        }
+    }
+
+    (void)picoquic_file_close(F_bin);
+    (void)picoquic_file_close(F_csv);
+
+    return ret;
+}
@@ -23,18 +23,130 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #include "picoquic_internal.h"
 #include "bytestream.h"
 #include "logreader.h"
 #include "logconvert.h"
 
+/*
+ * The qlog text is composed in a large memory buffer, which is written to
+ * the file when it is nearly full, instead of calling stdio for each item.
+ * Most items are constant strings, copied with qlog_puts; the formatted
+ * items are printed directly in the buffer.
+ */
+#define QLOG_OUT_BUFFER_SIZE 0x10000
+#define QLOG_OUT_ITEM_MAX 512
+
+typedef struct st_qlog_out_t {
+    FILE* f;
+    size_t length;
+    int is_error;
+    char buffer[QLOG_OUT_BUFFER_SIZE];
+} qlog_out_t;
+
+static void qlog_flush(qlog_out_t* f)
+{
+    if (f->length > 0) {
+        if (fwrite(f->buffer, 1, f->length, f->f) != f->length) {
+            f->is_error = 1;
+        }
+        f->length = 0;
+    }
+}
+
+static void qlog_write(qlog_out_t* f, const void* data, size_t length)
+{
+    if (f->length + length > QLOG_OUT_BUFFER_SIZE) {
+        qlog_flush(f);
+        if (length > QLOG_OUT_BUFFER_SIZE) {
+            if (fwrite(data, 1, length, f->f) != length) {
+                f->is_error = 1;
+            }
+            return;
+        }
+    }
+    memcpy(f->buffer + f->length, data, length);
+    f->length += length;
+}
+
+static void qlog_puts(qlog_out_t* f, const char* str)
+{
+    qlog_write(f, str, strlen(str));
+}
+
+static void qlog_printf(qlog_out_t* f, const char* fmt, ...)
+{
+    va_list args;
+    int l;
+
+    if (f->length + QLOG_OUT_ITEM_MAX > QLOG_OUT_BUFFER_SIZE) {
+        qlog_flush(f);
+    }
+    va_start(args, fmt);
+    l = vsnprintf(f->buffer + f->length, QLOG_OUT_BUFFER_SIZE - f->length, fmt, args);
+    va_end(args);
+    if (l < 0) {
+        f->is_error = 1;
+    }
+    else if ((size_t)l >= QLOG_OUT_BUFFER_SIZE - f->length) {
+        /* Only happens for very long items, e.g., long strings */
+        char* item = (char*)malloc((size_t)l + 1);
+
+        if (item == NULL) {
+            f->is_error = 1;
+        }
+        else {
+            va_start(args, fmt);
+            (void)vsnprintf(item, (size_t)l + 1, fmt, args);
+            va_end(args);
+            qlog_write(f, item, (size_t)l);
+            free(item);
+        }
+    }
+    else {
+        f->length += (size_t)l;
+    }
+}
+
+static void qlog_putc(qlog_out_t* f, int c)
+{
+    if (f->length >= QLOG_OUT_BUFFER_SIZE) {
+        qlog_flush(f);
+    }
+    f->buffer[f->length++] = (char)c;
+}
+
+static const char qlog_hex_digits[] = "0123456789abcdef";
+
+static void qlog_hex_byte(qlog_out_t* f, uint8_t b)
+{
+    char hex[2];
+
+    hex[0] = qlog_hex_digits[b >> 4];
+    hex[1] = qlog_hex_digits[b & 0x0f];
+    qlog_write(f, hex, 2);
+}
+
+/* The frame type names of the most common frames are formatted once per
+ * context, so the frame header is written with a single copy. */
+#define QLOG_FRAME_NAME_TABLE_SIZE 0x40
+
+typedef struct st_qlog_frame_name_t {
+    size_t length;
+    char text[64];
+} qlog_frame_name_t;
+
 typedef struct qlog_context_st {
 
     FILE * f_txtlog;      /*!< The file handle of the opened output file. */
+    qlog_out_t out;       /*!< Output buffer, written to f_txtlog */
+    qlog_frame_name_t frame_name[QLOG_FRAME_NAME_TABLE_SIZE];
 
     uint32_t version_number;
     const char * cid_name; /*!< Name of the connection, default = initial connection id */
+    char cid_text[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
     struct sockaddr_storage addr_peer;
     struct sockaddr_storage addr_local;
 
@@ -59,64 +171,65 @@ typedef struct qlog_context_st {
     unsigned int spin_bit_sent_last : 1;
     unsigned int spin_bit_sent : 1;
     unsigned int app_limited : 1;
+    unsigned int is_json_seq : 1; /*!< JSON-SEQ format, one record per event */
 
     int state;
 } qlog_context_t;
 
-int qlog_string(FILE* f, bytestream* s, uint64_t l)
+int qlog_string(qlog_out_t* f, bytestream* s, uint64_t l)
 {
     uint64_t x;
     int error_found = (s->ptr + (size_t)l > s->size);
 
-    fprintf(f, "\"");
+    qlog_puts(f, "\"");
 
     for (x = 0; x < l && s->ptr < s->size; x++) {
-        fprintf(f, "%02x", s->data[s->ptr++]);
+        qlog_hex_byte(f, s->data[s->ptr++]);
     }
 
     if (error_found) {
-        fprintf(f, "... coding error!");
+        qlog_puts(f, "... coding error!");
     }
 
-    fprintf(f, "\"");
+    qlog_puts(f, "\"");
     return (error_found) ? -1 : 0;
 }
 
-int qlog_chars(FILE* f, bytestream* s, uint64_t l)
+int qlog_chars(qlog_out_t* f, bytestream* s, uint64_t l)
 {
     uint64_t x;
     int error_found = (s->ptr + (size_t)l > s->size);
 
-    fprintf(f, "\"");
+    qlog_puts(f, "\"");
 
     for (x = 0; x < l && s->ptr < s->size; x++) {
         int c = s->data[s->ptr++];
         if (c == '"' || c == '\\') {
-            fprintf(f, "\\%c", c);
+            qlog_printf(f, "\\%c", c);
         }
         else if (c >= ' ' && c < 127) {
-            fprintf(f, "%c", c);
+            qlog_putc(f, c);
         }
         else {
-            fprintf(f, "\\%02x", c);
+            qlog_printf(f, "\\%02x", c);
         }
     }
 
     if (error_found) {
-        fprintf(f, "... coding error!");
+        qlog_puts(f, "... coding error!");
     }
 
-    fprintf(f, "\"");
+    qlog_puts(f, "\"");
     return (error_found) ? -1 : 0;
 }
 
-static void qlog_log_addr(FILE* f, struct sockaddr* addr_peer)
+static void qlog_log_addr(qlog_out_t* f, struct sockaddr* addr_peer)
 {
     if (addr_peer->sa_family == AF_INET) {
         struct sockaddr_in* s4 = (struct sockaddr_in*)addr_peer;
         uint8_t* addr = (uint8_t*)&s4->sin_addr;
 
-        fprintf(f, "\"ip_v4\": \"%d.%d.%d.%d\", \"port_v4\":%d",
+        qlog_printf(f, "\"ip_v4\": \"%d.%d.%d.%d\", \"port_v4\":%d",
             addr[0], addr[1], addr[2], addr[3],
             s4->sin_port);
     }
@@ -124,60 +237,96 @@ static void qlog_log_addr(FILE* f, struct sockaddr* addr_peer)
         struct sockaddr_in6* s6 = (struct sockaddr_in6*)addr_peer;
         uint8_t* addr = (uint8_t*)&s6->sin6_addr;
 
-        fprintf(f, " \"ip_v6\": \"");
+        qlog_puts(f, " \"ip_v6\": \"");
         for (int i = 0; i < 8; i++) {
             if (i != 0) {
-                fprintf(f, ":");
+                qlog_puts(f, ":");
             }
 
             if (addr[2 * i] != 0) {
-                fprintf(f, "%x%02x", addr[2 * i], addr[(2 * i) + 1]);
+                qlog_printf(f, "%x%02x", addr[2 * i], addr[(2 * i) + 1]);
             }
             else {
-                fprintf(f, "%x", addr[(2 * i) + 1]);
+                qlog_printf(f, "%x", addr[(2 * i) + 1]);
             }
         }
-        fprintf(f, "\", \"port_v6\" :%d", s6->sin6_port);
+        qlog_printf(f, "\", \"port_v6\" :%d", s6->sin6_port);
+    }
+}
+
+/* Events are separated by commas in the JSON format. In the JSON-SEQ
+ * format, each record starts with a record separator and ends with
+ * a line feed, which is written before the next record. */
+static void qlog_event_separator(qlog_out_t* f, qlog_context_t* ctx)
+{
+    if (ctx->is_json_seq) {
+        qlog_puts(f, "\n\x1e");
+    }
+    else if (ctx->event_count != 0) {
+        qlog_puts(f, ",\n");
+    }
+    else {
+        qlog_puts(f, "\n");
+    }
+}
+
+static void qlog_frame_name_init(qlog_context_t* ctx)
+{
+    for (size_t i = 0; i < QLOG_FRAME_NAME_TABLE_SIZE; i++) {
+        if (picoquic_sprintf(ctx->frame_name[i].text, sizeof(ctx->frame_name[i].text), &ctx->frame_name[i].length,
+            "\n    \"frame_type\": \"%s\"", ftype2str((picoquic_frame_type_enum_t)i)) != 0) {
+            ctx->frame_name[i].length = 0;
+        }
+    }
+}
+
+static void qlog_frame_type(qlog_out_t* f, qlog_context_t* ctx, uint64_t ftype)
+{
+    if (ftype < QLOG_FRAME_NAME_TABLE_SIZE && ctx->frame_name[ftype].length > 0) {
+        qlog_write(f, ctx->frame_name[ftype].text, ctx->frame_name[ftype].length);
+    }
+    else {
+        qlog_printf(f, "\n    \"frame_type\": \"%s\"", ftype2str((picoquic_frame_type_enum_t)ftype));
     }
 }
 
-void qlog_event_header(FILE * f, qlog_context_t* ctx, int64_t delta_time, uint64_t path_id, char const * event_class, char const * event_name)
+void qlog_event_header(qlog_out_t* f, qlog_context_t* ctx, int64_t delta_time, uint64_t path_id, char const * event_class, char const * event_name)
 {
-    fprintf(f, "[%"PRId64", ", delta_time);
+    qlog_printf(f, "[%"PRId64", ", delta_time);
     if (ctx->trace_flow_id) {
-        fprintf(f, "%"PRId64", ", path_id);
+        qlog_printf(f, "%"PRId64", ", path_id);
     }
-    fprintf(f, "\"%s\", \"%s\", {", event_class, event_name);
+    qlog_printf(f, "\"%s\", \"%s\", {", event_class, event_name);
 }
 
-void qlog_vint_transport_extension(FILE* f, char const* ext_name, bytestream* s, uint64_t len)
+void qlog_vint_transport_extension(qlog_out_t* f, char const* ext_name, bytestream* s, uint64_t len)
 {
     uint64_t val;
     size_t current_ptr = s->ptr;
     int ret = byteread_vint(s, &val);
 
-    fprintf(f, "\"%s\" : ", ext_name);
+    qlog_printf(f, "\"%s\" : ", ext_name);
     if (ret != 0 || current_ptr + (size_t)len != s->ptr) {
         s->ptr = current_ptr;
         qlog_string(f, s, len);
     }
     else {
-        fprintf(f, "%" PRIu64, val);
+        qlog_printf(f, "%" PRIu64, val);
     }
 }
 
-void qlog_boolean_transport_extension(FILE* f, char const* ext_name, bytestream* s, uint64_t len)
+void qlog_boolean_transport_extension(qlog_out_t* f, char const* ext_name, bytestream* s, uint64_t len)
 {
-    fprintf(f, "\"%s\" : ", ext_name);
+    qlog_printf(f, "\"%s\" : ", ext_name);
     if (len != 0) {
         qlog_string(f, s, len);
     }
     else {
-        fprintf(f, "\"\"");
+        qlog_puts(f, "\"\"");
     }
 }
 
-void qlog_preferred_address(FILE* f, bytestream* s, uint64_t len)
+void qlog_preferred_address(qlog_out_t* f, bytestream* s, uint64_t len)
 {
     uint16_t port4 =0;
     uint16_t port6 = 0;
@@ -186,81 +335,81 @@ void qlog_preferred_address(FILE* f, bytestream* s, uint64_t len)
 
     s->size = s->ptr + (size_t) len;
 
-    fprintf(f, "\"ip_v4\": \"");
+    qlog_puts(f, "\"ip_v4\": \"");
     for (int i = 0; i < 4 && s->ptr < s->size; i++, s->ptr++) {
-        fprintf(f, "%s%d", (i == 0) ? "" : ".", s->data[s->ptr]);
+        qlog_printf(f, "%s%d", (i == 0) ? "" : ".", s->data[s->ptr]);
     }
     byteread_int16(s, &port4);
-    fprintf(f, "\", \"port_v4\":%d", port4);
-    fprintf(f, ", \"ip_v6\": \"");
+    qlog_printf(f, "\", \"port_v4\":%d", port4);
+    qlog_puts(f, ", \"ip_v6\": \"");
     for (int i = 0; i < 8; i++) {
         uint16_t chunk = 0;
         byteread_int16(s, &chunk);
-        fprintf(f, "%s%x", (i == 0) ? "" : ":", chunk);
+        qlog_printf(f, "%s%x", (i == 0) ? "" : ":", chunk);
     }
     byteread_int16(s, &port6);
-    fprintf(f, "\", \"port_v6\" : %d", port6);
+    qlog_printf(f, "\", \"port_v6\" : %d", port6);
     byteread_int8(s, &cid_len);
-    fprintf(f, ", \"connection_id\": ");
+    qlog_puts(f, ", \"connection_id\": ");
     qlog_string(f, s, cid_len);
-    fprintf(f, ", \"stateless_reset_token\": ");
+    qlog_puts(f, ", \"stateless_reset_token\": ");
     qlog_string(f, s, 16);
     if (s->ptr < s->size) {
-        fprintf(f, "\", \"extra_bytes\": ");
+        qlog_puts(f, "\", \"extra_bytes\": ");
         qlog_string(f, s, bytestream_remain(s));
     }
     s->size = old_size;
 }
 
-void qlog_tp_version_negotiation(FILE* f, bytestream* s, uint64_t len)
+void qlog_tp_version_negotiation(qlog_out_t* f, bytestream* s, uint64_t len)
 {
     size_t old_size = s->size;
     size_t ptr_max = s->ptr + (size_t)len;
 
     if (ptr_max > s->size) {
-        fprintf(f, ",\n    \"vnego_parameter_length\": %zu", (size_t)len);
-        fprintf(f, ",\n    \"bytes_available\": %zu", s->size - s->ptr);
+        qlog_printf(f, ",\n    \"vnego_parameter_length\": %zu", (size_t)len);
+        qlog_printf(f, ",\n    \"bytes_available\": %zu", s->size - s->ptr);
     }
     else {
         s->size = s->ptr + (size_t)len;
-        fprintf(f, "{ ");
+        qlog_puts(f, "{ ");
         if ((len & 3) != 0 || len == 0) {
-            fprintf(f, "\"bad_length\": \"%" PRIu64, len);
+            qlog_printf(f, "\"bad_length\": \"%" PRIu64, len);
         }
         else {
-            fprintf(f, "\"chosen\": \"");
+            qlog_puts(f, "\"chosen\": \"");
             for (int i = 0; i < 4 && s->ptr < s->size; i++, s->ptr++) {
-                fprintf(f, "%02x", s->data[s->ptr]);
+                qlog_hex_byte(f, s->data[s->ptr]);
             }
-            fprintf(f, "\"");
+            qlog_puts(f, "\"");
             if (s->ptr < s->size) {
                 int is_first = 1;
-                fprintf(f, ", \"others\": [");
+                qlog_puts(f, ", \"others\": [");
                 do {
-                    fprintf(f, "%s", (is_first) ? "\"" : ", \"");
+                    qlog_printf(f, "%s", (is_first) ? "\"" : ", \"");
                     is_first = 0;
                     for (int i = 0; i < 4 && s->ptr < s->size; i++, s->ptr++) {
-                        fprintf(f, "%02x", s->data[s->ptr]);
+                        qlog_hex_byte(f, s->data[s->ptr]);
                     }
-                    fprintf(f, "\"");
+                    qlog_puts(f, "\"");
                 } while (s->ptr < s->size);
-                fprintf(f, "]");
+                qlog_puts(f, "]");
             }
         }
-        fprintf(f, "}");
+        qlog_puts(f, "}");
         s->size = old_size;
     }
 }
 
 
-int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
+int qlog_transport_extensions(qlog_out_t* f, bytestream* v, size_t tp_length)
 {
     int ret = 0;
     size_t ptr_max = v->ptr + tp_length;
 
     if (ptr_max > v->size) {
-        fprintf(f, ",\n    \"transport_parameter_length\": %zu", tp_length);
-        fprintf(f, ",\n    \"bytes_available\": %zu" PRIu64, v->size - v->ptr);
+        qlog_printf(f, ",\n    \"transport_parameter_length\": %zu", tp_length);
+        qlog_printf(f, ",\n    \"bytes_available\": %zu" PRIu64, v->size - v->ptr);
     } else {
         bytestream bs = { 0 };
         bytestream* s = &bs;
@@ -277,7 +426,7 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
             ret |= byteread_vint(s, &extension_type);
             ret |= byteread_vint(s, &extension_length);
 
-            fprintf(f, ",\n    ");
+            qlog_puts(f, ",\n    ");
 
             if (ret != 0 || bytestream_remain(s) < extension_length) {
                 size_t len = 0;
@@ -285,7 +434,7 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
                 s->ptr = current_ptr;
                 len = bytestream_remain(s);
                 /* Print invalid parameter there */
-                fprintf(f, "\"Parameter_coding_error\": ");
+                qlog_puts(f, "\"Parameter_coding_error\": ");
                 qlog_string(f, s, len);
                 break;
             }
@@ -313,7 +462,7 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
                     qlog_vint_transport_extension(f, "max_packet_size", s, extension_length);
                     break;
                 case picoquic_tp_stateless_reset_token:
-                    fprintf(f, "\"stateless_reset_token\": ");
+                    qlog_puts(f, "\"stateless_reset_token\": ");
                     qlog_string(f, s, extension_length);
                     break;
                 case picoquic_tp_ack_delay_exponent:
@@ -323,9 +472,9 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
                     qlog_vint_transport_extension(f, "initial_max_streams_uni", s, extension_length);
                     break;
                 case picoquic_tp_server_preferred_address: 
-                    fprintf(f, "\"server_preferred_address\": {"); 
+                    qlog_puts(f, "\"server_preferred_address\": {"); 
                     qlog_preferred_address(f, s, extension_length);
-                    fprintf(f, "}");
+                    qlog_puts(f, "}");
                     break;
                 case picoquic_tp_disable_migration:
                     qlog_boolean_transport_extension(f, "disable_migration", s, extension_length);
@@ -334,15 +483,15 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
                     qlog_vint_transport_extension(f, "max_ack_delay", s, extension_length);
                     break;
                 case picoquic_tp_original_connection_id:
-                    fprintf(f, "\"original_connection_id\": ");
+                    qlog_puts(f, "\"original_connection_id\": ");
                     qlog_string(f, s, extension_length);
                     break;
                 case picoquic_tp_retry_connection_id:
-                    fprintf(f, "\"retry_connection_id\": ");
+                    qlog_puts(f, "\"retry_connection_id\": ");
                     qlog_string(f, s, extension_length);
                     break;
                 case picoquic_tp_handshake_connection_id:
-                    fprintf(f, "\"handshake_connection_id\": ");
+                    qlog_puts(f, "\"handshake_connection_id\": ");
                     qlog_string(f, s, extension_length);
                     break;
                 case picoquic_tp_active_connection_id_limit:
@@ -364,12 +513,15 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
                     qlog_boolean_transport_extension(f, "grease_quic_bit", s, extension_length);
                     break;
                 case picoquic_tp_version_negotiation:
-                    fprintf(f, "\"version_negotiation\": ");
+                    qlog_puts(f, "\"version_negotiation\": ");
                     qlog_tp_version_negotiation(f, s, extension_length);
                     break;
                 case picoquic_tp_enable_bdp_frame:
                     qlog_vint_transport_extension(f, "enable_bdp_frame", s, extension_length);
                     break;
+                case picoquic_tp_enable_fec:
+                    qlog_vint_transport_extension(f, "enable_fec", s, extension_length);
+                    break;
                 case picoquic_tp_initial_max_path_id:
                     qlog_vint_transport_extension(f, "initial_max_path_id", s, extension_length);
                     break;
@@ -378,7 +530,7 @@ int qlog_transport_extensions(FILE* f, bytestream* v, size_t tp_length)
                     break;
                 default:
                     /* dump unknown extensions */
-                    fprintf(f, "\"%" PRIx64 "\": ", extension_type);
+                    qlog_printf(f, "\"%" PRIx64 "\": ", extension_type);
                     qlog_string(f, s, extension_length);
                     break;
                 }
@@ -394,7 +546,7 @@ int qlog_alpn_update(uint64_t time, bytestream* s, void* ptr)
 {
     qlog_context_t* ctx = (qlog_context_t*)ptr;
     int64_t delta_time = time - ctx->start_time;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     uint64_t owner = 0;
     uint64_t sni_length = 0;
     uint64_t alpn_length = 0;
@@ -403,44 +555,39 @@ int qlog_alpn_update(uint64_t time, bytestream* s, void* ptr)
 
     ret |= byteread_vint(s, &owner);
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     ret |= byteread_vint(s, &sni_length);
     qlog_event_header(f, ctx, delta_time, 0, "transport", "parameters_set");
-    fprintf(f, "\n    \"owner\": \"%s\"", (owner) ? "local" : "remote");
+    qlog_printf(f, "\n    \"owner\": \"%s\"", (owner) ? "local" : "remote");
     if (sni_length > 0) {
-        fprintf(f, ",\n    \"sni\": ");
+        qlog_puts(f, ",\n    \"sni\": ");
         ret |= qlog_chars(f, s, sni_length);
     }
 
     ret |= byteread_vint(s, &alpn_count);
     if (ret == 0 && alpn_count > 0) {
-        fprintf(f, ",\n    \"proposed_alpn\": [");
+        qlog_puts(f, ",\n    \"proposed_alpn\": [");
 
         for (size_t i = 0; i < alpn_count; i++) {
             uint64_t len;
             if (i != 0) {
-                fprintf(f, ", ");
+                qlog_puts(f, ", ");
             }
             ret |= byteread_vint(s, &len);
             ret |= qlog_chars(f, s, len);
         }
-        fprintf(f, "]");
+        qlog_puts(f, "]");
     }
 
 
     ret |= byteread_vint(s, &alpn_length);
     if (ret == 0 && alpn_length > 0) {
-        fprintf(f, ",\n    \"alpn\": ");
+        qlog_puts(f, ",\n    \"alpn\": ");
         qlog_chars(f, s, alpn_length);
     }
 
-    fprintf(f, "}]");
+    qlog_puts(f, "}]");
 
     ctx->event_count++;
 
@@ -452,23 +599,18 @@ int qlog_param_update(uint64_t time, bytestream* s, void* ptr)
 {
     qlog_context_t* ctx = (qlog_context_t*)ptr;
     int64_t delta_time = time - ctx->start_time;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     uint64_t owner = 0;
     uint64_t tp_length = 0;
     int ret = 0;
 
     ret |= byteread_vint(s, &owner);
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     qlog_event_header(f, ctx, delta_time, 0, "transport", "parameters_set");
 
-    fprintf(f, "\n    \"owner\": \"%s\"", (owner)?"local":"remote");
+    qlog_printf(f, "\n    \"owner\": \"%s\"", (owner)?"local":"remote");
 
     ret |= byteread_vint(s, &tp_length);
 
@@ -476,7 +618,7 @@ int qlog_param_update(uint64_t time, bytestream* s, void* ptr)
         qlog_transport_extensions(f, s, (size_t)tp_length);
     }
     
-    fprintf(f, "}]");
+    qlog_puts(f, "}]");
 
     ctx->event_count++;
 
@@ -487,7 +629,7 @@ int qlog_packet_lost(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
 {
     qlog_context_t* ctx = (qlog_context_t*)ptr;
     int64_t delta_time = time - ctx->start_time;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     uint64_t packet_type = 0;
     uint64_t sequence = 0;
     uint64_t trigger_length;
@@ -499,33 +641,28 @@ int qlog_packet_lost(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
     ret |= byteread_vint(s, &sequence);
     ret |= byteread_vint(s, &trigger_length);
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     qlog_event_header(f, ctx, delta_time, path_id, "recovery", "packet_lost");
-    fprintf(f, "\n    \"packet_type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
-    fprintf(f, ",\n    \"packet_number\" : %" PRIu64, sequence);
+    qlog_printf(f, "\n    \"packet_type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
+    qlog_printf(f, ",\n    \"packet_number\" : %" PRIu64, sequence);
     if (trigger_length > 0) {
-        fprintf(f, ",\n    \"trigger\": ");
+        qlog_puts(f, ",\n    \"trigger\": ");
         ret |= qlog_chars(f, s, trigger_length);
     }
-    fprintf(f, ",\n    \"header\": {");
-    fprintf(f, "\n        \"packet_type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
-    fprintf(f, ",\n        \"packet_number\" : %" PRIu64, sequence);
+    qlog_puts(f, ",\n    \"header\": {");
+    qlog_printf(f, "\n        \"packet_type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
+    qlog_printf(f, ",\n        \"packet_number\" : %" PRIu64, sequence);
     ret |= byteread_int8(s, &cid_len);
     if (ret == 0 && cid_len > 0) {
-        fprintf(f, ",\n        \"dcid\" : ");
+        qlog_puts(f, ",\n        \"dcid\" : ");
         qlog_string(f, s, cid_len);
     }
     ret |= byteread_vint(s, &packet_size);
     if (ret == 0) {
-        fprintf(f, ",\n        \"packet_size\" : %" PRIu64, packet_size);
+        qlog_printf(f, ",\n        \"packet_size\" : %" PRIu64, packet_size);
     }
-    fprintf(f, "}}]");
+    qlog_puts(f, "}}]");
 
     ctx->event_count++;
 
@@ -536,7 +673,7 @@ int qlog_packet_dropped(uint64_t time, uint64_t path_id, bytestream* s, void* pt
 {
     qlog_context_t* ctx = (qlog_context_t*)ptr;
     int64_t delta_time = time - ctx->start_time;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     uint64_t packet_type = 0;
     uint64_t err_code;
     uint64_t packet_size = 0;
@@ -549,16 +686,11 @@ int qlog_packet_dropped(uint64_t time, uint64_t path_id, bytestream* s, void* pt
     ret |= byteread_vint(s, &err_code);
     ret |= byteread_vint(s, &raw_len);
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     qlog_event_header(f, ctx, delta_time, path_id, "transport", "packet_dropped");
-    fprintf(f, "\n    \"packet_type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
-    fprintf(f, ",\n    \"packet_size\" : %" PRIu64, packet_size);
+    qlog_printf(f, "\n    \"packet_type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
+    qlog_printf(f, ",\n    \"packet_size\" : %" PRIu64, packet_size);
     switch (err_code) {
     case PICOQUIC_ERROR_DUPLICATE:
         str = "dos_prevention";
@@ -588,13 +720,13 @@ int qlog_packet_dropped(uint64_t time, uint64_t path_id, bytestream* s, void* pt
         str = "protocol_violation";
         break;
     }
-    fprintf(f, ",\n    \"trigger\": \"%s\"", str);
+    qlog_printf(f, ",\n    \"trigger\": \"%s\"", str);
 
     if (ret == 0 && raw_len > 0) {
-        fprintf(f, ",\n    \"raw\": ");
+        qlog_puts(f, ",\n    \"raw\": ");
         qlog_string(f, s, raw_len);
     }
-    fprintf(f, "}]");
+    qlog_puts(f, "}]");
 
     ctx->event_count++;
 
@@ -605,7 +737,7 @@ int qlog_packet_buffered(uint64_t time, uint64_t path_id, bytestream* s, void* p
 {
     qlog_context_t* ctx = (qlog_context_t*)ptr;
     int64_t delta_time = time - ctx->start_time;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     uint64_t packet_type = 0;
     uint64_t trigger_length = 0;
     int ret = 0;
@@ -613,20 +745,15 @@ int qlog_packet_buffered(uint64_t time, uint64_t path_id, bytestream* s, void* p
     ret |= byteread_vint(s, &packet_type);
     ret |= byteread_vint(s, &trigger_length);
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     qlog_event_header(f, ctx, delta_time, path_id, "transport", "packet_buffered");
 
 
-    fprintf(f, "\n    \"type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
-    fprintf(f, ",\n    \"trigger\": ");
+    qlog_printf(f, "\n    \"type\" : \"%s\"", ptype2str((picoquic_packet_type_enum)packet_type));
+    qlog_puts(f, ",\n    \"trigger\": ");
     qlog_chars(f, s, trigger_length);
-    fprintf(f, "}]");
+    qlog_puts(f, "}]");
 
     ctx->event_count++;
 
@@ -637,7 +764,7 @@ int qlog_pdu(uint64_t time, int rxtx, bytestream* s, void * ptr)
 {
     qlog_context_t* ctx = (qlog_context_t*)ptr;
     int64_t delta_time = time - ctx->start_time;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     struct sockaddr_storage addr_peer = { 0 };
     struct sockaddr_storage addr_local = { 0 };
     uint64_t byte_length = 0;
@@ -649,34 +776,29 @@ int qlog_pdu(uint64_t time, int rxtx, bytestream* s, void * ptr)
     ret_local = byteread_addr(s, &addr_local);
     byteread_vint(s, &unique_path_id);
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     qlog_event_header(f, ctx, delta_time, unique_path_id, "transport", (rxtx == 0) ? "datagram_sent" : "datagram_received");
 
-    fprintf(f, " \"byte_length\": %" PRIu64, byte_length);
+    qlog_printf(f, " \"byte_length\": %" PRIu64, byte_length);
 
     if (addr_peer.ss_family != 0 &&
         picoquic_compare_addr((struct sockaddr*)&addr_peer, (struct sockaddr*) & ctx->addr_peer) != 0) {
-        fprintf(f, ", \"%s\" : {", (rxtx == 0) ? "addr_to" : "addr_from");
+        qlog_printf(f, ", \"%s\" : {", (rxtx == 0) ? "addr_to" : "addr_from");
         qlog_log_addr(f, (struct sockaddr*) & addr_peer);
-        fprintf(f, "}");
+        qlog_puts(f, "}");
         picoquic_store_addr(&ctx->addr_peer, (struct sockaddr*) & addr_peer);
     }
 
     if (ret_local == 0 && addr_local.ss_family != 0 &&
         picoquic_compare_addr((struct sockaddr*) & addr_local, (struct sockaddr*) & ctx->addr_local) != 0) {
-        fprintf(f, ", \"%s\" : {", (rxtx != 0) ? "addr_to" : "addr_from");
+        qlog_printf(f, ", \"%s\" : {", (rxtx != 0) ? "addr_to" : "addr_from");
         qlog_log_addr(f, (struct sockaddr*) & addr_local);
-        fprintf(f, "}");
+        qlog_puts(f, "}");
         picoquic_store_addr(&ctx->addr_local, (struct sockaddr*) & addr_local);
     }
 
-    fprintf(f, "}]");
+    qlog_puts(f, "}]");
     ctx->event_count++;
     return 0;
 }
@@ -684,60 +806,58 @@ int qlog_pdu(uint64_t time, int rxtx, bytestream* s, void * ptr)
 int qlog_packet_start(uint64_t time, uint64_t path_id, uint64_t size, const picoquic_packet_header * ph, int rxtx, void * ptr)
 {
     qlog_context_t * ctx = (qlog_context_t*)ptr;
-    FILE * f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     int64_t delta_time = time - ctx->start_time;
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    } else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     if (ph->ptype == picoquic_packet_1rtt_protected && rxtx == 0) {
         if (ctx->spin_bit_sent && (ctx->spin_bit_sent_last != ph->spin)) {
             qlog_event_header(f, ctx, delta_time, path_id, "transport", "spin_bit_updated");
-            fprintf(f, " \"state\": %s }],\n", (ph->spin) ? "true" : "false");
+            qlog_printf(f, " \"state\": %s }]", (ph->spin) ? "true" : "false");
+            ctx->event_count++;
+            qlog_event_separator(f, ctx);
         }
         ctx->spin_bit_sent = 1;
         ctx->spin_bit_sent_last = ph->spin;
     }
 
     qlog_event_header(f, ctx, delta_time, path_id, "transport", (rxtx == 0) ? "packet_sent" : "packet_received");
-    fprintf(f, " \"packet_type\": \"%s\", \"header\": { \"packet_size\": %"PRIu64 , ptype2str(ph->ptype), size);
+    qlog_printf(f, " \"packet_type\": \"%s\", \"header\": { \"packet_size\": %"PRIu64 , ptype2str(ph->ptype), size);
 
     if (ph->ptype != picoquic_packet_version_negotiation &&
         ph->ptype != picoquic_packet_retry) {
-        fprintf(f, ", \"packet_number\": %"PRIu64, ph->pn64);
+        qlog_printf(f, ", \"packet_number\": %"PRIu64, ph->pn64);
     }
 
     if (ph->ptype != picoquic_packet_1rtt_protected) {
         if (ctx->version_number != ph->vn) {
-            fprintf(f, ", \"version\": \"%08x\"", ph->vn);
+            qlog_printf(f, ", \"version\": \"%08x\"", ph->vn);
             ctx->version_number = ph->vn;
         }
         if (ph->ptype != picoquic_packet_version_negotiation &&
             ph->ptype != picoquic_packet_retry &&
             ph->ptype != picoquic_packet_error) {
-            fprintf(f, ", \"payload_length\": %zu", ph->payload_length);
+            qlog_printf(f, ", \"payload_length\": %zu", ph->payload_length);
         }
     }
 
     if (ph->ptype != picoquic_packet_1rtt_protected && ph->srce_cnx_id.id_len > 0) {
         char scid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
         picoquic_print_connection_id_hexa(scid_name, sizeof(scid_name), &ph->srce_cnx_id);
-        fprintf(f, ", \"scid\": \"%s\"", scid_name);
+        qlog_printf(f, ", \"scid\": \"%s\"", scid_name);
     }
 
     if (ph->dest_cnx_id.id_len > 0) {
         char dcid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
         picoquic_print_connection_id_hexa(dcid_name, sizeof(dcid_name), &ph->dest_cnx_id);
-        fprintf(f, ", \"dcid\": \"%s\"", dcid_name);
+        qlog_printf(f, ", \"dcid\": \"%s\"", dcid_name);
     }
 
     if (ph->ptype == picoquic_packet_initial && ph->token_length > 0) {
         bytestream token;
         bytestream_ref_init(&token, ph->token_bytes, ph->token_length);
-        fprintf(f, ", \"token\": ");
+        qlog_puts(f, ", \"token\": ");
         qlog_string(f, &token, ph->token_length);
     }
 
@@ -755,219 +875,219 @@ int qlog_packet_start(uint64_t time, uint64_t path_id, uint64_t size, const pico
             ctx->key_phase_received = 1;
         }
         if (need_key_phase) {
-            fprintf(f, ", \"key_phase\": %d", ph->key_phase);
+            qlog_printf(f, ", \"key_phase\": %d", ph->key_phase);
         }
     }
 
     if (ph->quic_bit_is_zero) {
-        fprintf(f, ", \"quic_bit\": 0");
+        qlog_puts(f, ", \"quic_bit\": 0");
     }
 
     ctx->packet_type = ph->ptype;
 
     if (ctx->packet_type == picoquic_packet_version_negotiation ||
         ctx->packet_type == picoquic_packet_retry) {
-        fprintf(f, " }");
+        qlog_puts(f, " }");
     }
     else {
-        fprintf(f, " }, \"frames\": [");
+        qlog_puts(f, " }, \"frames\": [");
     }
 
     ctx->frame_count = 0;
     return 0;
 }
 
-void qlog_time_stamp_frame(FILE* f, bytestream* s)
+void qlog_time_stamp_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t time_stamp = 0;
 
     byteread_vint(s, &time_stamp);
-    fprintf(f, ", \"time_stamp\": %"PRIu64"", time_stamp);
+    qlog_printf(f, ", \"time_stamp\": %"PRIu64"", time_stamp);
 }
 
-void qlog_path_abandon_frame(FILE* f, bytestream* s)
+void qlog_path_abandon_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t path_id;
     uint64_t reason;
     
     byteread_vint(s, &path_id);
     byteread_vint(s, &reason);
-    fprintf(f, ", \"path_id\": %"PRIu64, path_id);
-    fprintf(f, ", \"reason\": %"PRIu64, reason);
+    qlog_printf(f, ", \"path_id\": %"PRIu64, path_id);
+    qlog_printf(f, ", \"reason\": %"PRIu64, reason);
 }
 
-void qlog_path_backup_frame(FILE* f, bytestream* s)
+void qlog_path_backup_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t path_id = 0;
     uint64_t sequence;
 
     byteread_vint(s, &path_id);
     byteread_vint(s, &sequence);
-    fprintf(f, ", \"path_id\": %"PRIu64, path_id);
-    fprintf(f, ", \"sequence\": %"PRIu64, sequence);
+    qlog_printf(f, ", \"path_id\": %"PRIu64, path_id);
+    qlog_printf(f, ", \"sequence\": %"PRIu64, sequence);
 }
 
-void qlog_path_available_frame(FILE* f, bytestream* s)
+void qlog_path_available_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t path_id = 0;
     uint64_t sequence;
 
     byteread_vint(s, &path_id);
     byteread_vint(s, &sequence);
-    fprintf(f, ", \"path_id\": %"PRIu64, path_id);
-    fprintf(f, ", \"sequence\": %"PRIu64, sequence);
+    qlog_printf(f, ", \"path_id\": %"PRIu64, path_id);
+    qlog_printf(f, ", \"sequence\": %"PRIu64, sequence);
 }
 
-void qlog_max_path_id_frame(FILE* f, bytestream* s)
+void qlog_max_path_id_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t max_path_id = 0;
     byteread_vint(s, &max_path_id);
-    fprintf(f, ", \"max_path_id\": %"PRIu64, max_path_id);
+    qlog_printf(f, ", \"max_path_id\": %"PRIu64, max_path_id);
 }
 
-void qlog_paths_blocked_frame(FILE* f, bytestream* s)
+void qlog_paths_blocked_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t max_path_id = 0;
     byteread_vint(s, &max_path_id);
-    fprintf(f, ", \"max_path_id\": %"PRIu64, max_path_id);
+    qlog_printf(f, ", \"max_path_id\": %"PRIu64, max_path_id);
 }
 
-void qlog_path_cid_blocked_frame(FILE* f, bytestream* s)
+void qlog_path_cid_blocked_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t path_id = 0;
     uint64_t next_sequence_number = 0;
     byteread_vint(s, &path_id);
     byteread_vint(s, &next_sequence_number);
-    fprintf(f, ", \"path_id\": %"PRIu64, path_id);
-    fprintf(f, ", \"next_sequence_number\": %"PRIu64, next_sequence_number);
+    qlog_printf(f, ", \"path_id\": %"PRIu64, path_id);
+    qlog_printf(f, ", \"next_sequence_number\": %"PRIu64, next_sequence_number);
 }
 
-void qlog_reset_stream_frame(FILE* f, bytestream* s)
+void qlog_reset_stream_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t stream_id = 0;
     uint64_t error_code = 0;
     uint64_t final_size = 0;
 
     byteread_vint(s, &stream_id);
-    fprintf(f, ", \"stream_id\": %"PRIu64"", stream_id);
+    qlog_printf(f, ", \"stream_id\": %"PRIu64"", stream_id);
     byteread_vint(s, &error_code);
-    fprintf(f, ", \"error_code\": %"PRIu64"", error_code);
+    qlog_printf(f, ", \"error_code\": %"PRIu64"", error_code);
     byteread_vint(s, &final_size);
-    fprintf(f, ", \"final_size\": %"PRIu64"", final_size);
+    qlog_printf(f, ", \"final_size\": %"PRIu64"", final_size);
 }
 
-void qlog_stop_sending_frame(FILE* f, bytestream* s)
+void qlog_stop_sending_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t stream_id = 0;
     uint64_t error_code = 0;
 
     byteread_vint(s, &stream_id);
-    fprintf(f, ", \"stream_id\": %"PRIu64"", stream_id);
+    qlog_printf(f, ", \"stream_id\": %"PRIu64"", stream_id);
     byteread_vint(s, &error_code);
-    fprintf(f, ", \"error_code\": %"PRIu64"", error_code);
+    qlog_printf(f, ", \"error_code\": %"PRIu64"", error_code);
 }
 
-void qlog_closing_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_closing_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     uint64_t error_code = 0;
     uint64_t offending_frame_type = 0;
     uint64_t reason_length = 0;
     char const* offensive_type_name = NULL;
 
-    fprintf(f, ", \"error_space\": \"%s\"", 
+    qlog_printf(f, ", \"error_space\": \"%s\"", 
         (ftype == picoquic_frame_type_connection_close)?"transport":"application");
     byteread_vint(s, &error_code);
-    fprintf(f, ", \"error_code\": %"PRIu64"", error_code);
+    qlog_printf(f, ", \"error_code\": %"PRIu64"", error_code);
     
     if (ftype == picoquic_frame_type_connection_close &&
         error_code != 0) {
         byteread_vint(s, &offending_frame_type);
         offensive_type_name = ftype2str(offending_frame_type);
         if (strcmp(offensive_type_name, "unknown") == 0) {
-            fprintf(f, ", \"trigger_frame_type\": \"%"PRIx64"\"", offending_frame_type);
+            qlog_printf(f, ", \"trigger_frame_type\": \"%"PRIx64"\"", offending_frame_type);
         }
         else {
-            fprintf(f, ", \"trigger_frame_type\": \"%s\"", offensive_type_name);
+            qlog_printf(f, ", \"trigger_frame_type\": \"%s\"", offensive_type_name);
         }
     }
 
     byteread_vint(s, &reason_length);
     if (reason_length > 0){
-        fprintf(f, ", \"reason\": \"");
+        qlog_puts(f, ", \"reason\": \"");
         for (uint64_t i = 0; i < reason_length && s->ptr < s->size; i++) {
             int c = s->data[s->ptr++];
 
             if (c < 0x20 || c > 0x7E) {
                 c = '.';
             }
-            fprintf(f, "%c", c);
+            qlog_putc(f, c);
         }
-        fprintf(f, "\"");
+        qlog_puts(f, "\"");
     }
 }
 
-void qlog_max_data_frame(FILE* f, bytestream* s)
+void qlog_max_data_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t maximum = 0;
     byteread_vint(s, &maximum);
-    fprintf(f, ", \"maximum\": %"PRIu64"", maximum);
+    qlog_printf(f, ", \"maximum\": %"PRIu64"", maximum);
 }
 
-void qlog_max_stream_data_frame(FILE* f, bytestream* s)
+void qlog_max_stream_data_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t stream_id = 0;
     uint64_t maximum = 0;
 
     byteread_vint(s, &stream_id);
-    fprintf(f, ", \"stream_id\": %"PRIu64"", stream_id);
+    qlog_printf(f, ", \"stream_id\": %"PRIu64"", stream_id);
     byteread_vint(s, &maximum);
-    fprintf(f, ", \"maximum\": %"PRIu64"", maximum);
+    qlog_printf(f, ", \"maximum\": %"PRIu64"", maximum);
 }
 
-void qlog_max_streams_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_max_streams_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     uint64_t maximum;
 
-    fprintf(f, ", \"stream_type\": \"%s\"",
+    qlog_printf(f, ", \"stream_type\": \"%s\"",
         (ftype == picoquic_frame_type_max_streams_bidir) ?
         "bidirectional" : "unidirectional");
 
     byteread_vint(s, &maximum);
-    fprintf(f, ", \"maximum\": %"PRIu64"", maximum);
+    qlog_printf(f, ", \"maximum\": %"PRIu64"", maximum);
 }
 
-void qlog_blocked_frame(FILE* f, bytestream* s)
+void qlog_blocked_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t limit = 0;
 
     byteread_vint(s, &limit);
-    fprintf(f, ", \"limit\": %"PRIu64"", limit);
+    qlog_printf(f, ", \"limit\": %"PRIu64"", limit);
 }
 
-void qlog_stream_blocked_frame(FILE* f, bytestream* s)
+void qlog_stream_blocked_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t stream_id = 0;
     uint64_t limit = 0;
 
     byteread_vint(s, &stream_id);
-    fprintf(f, ", \"stream_id\": %"PRIu64"", stream_id);
+    qlog_printf(f, ", \"stream_id\": %"PRIu64"", stream_id);
     byteread_vint(s, &limit);
-    fprintf(f, ", \"limit\": %"PRIu64"", limit);
+    qlog_printf(f, ", \"limit\": %"PRIu64"", limit);
 }
 
-void qlog_streams_blocked_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_streams_blocked_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     uint64_t limit;
 
-    fprintf(f, ", \"stream_type\": \"%s\"", 
+    qlog_printf(f, ", \"stream_type\": \"%s\"", 
         (ftype == picoquic_frame_type_streams_blocked_bidir)?
         "bidirectional":"unidirectional");
 
     byteread_vint(s, &limit);
-    fprintf(f, ", \"limit\": %"PRIu64"", limit);
+    qlog_printf(f, ", \"limit\": %"PRIu64"", limit);
 }
 
-void qlog_new_connection_id_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_new_connection_id_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     uint64_t sequence_number = 0;
     uint64_t retire_before = 0;
@@ -976,94 +1096,94 @@ void qlog_new_connection_id_frame(uint64_t ftype, FILE* f, bytestream* s)
     if (ftype == picoquic_frame_type_path_new_connection_id) {
         uint64_t path_id;
         byteread_vint(s, &path_id);
-        fprintf(f, ", \"path_id\": %"PRIu64"", path_id);
+        qlog_printf(f, ", \"path_id\": %"PRIu64"", path_id);
     }
 
     byteread_vint(s, &sequence_number);
-    fprintf(f, ", \"sequence_number\": %"PRIu64"", sequence_number);
+    qlog_printf(f, ", \"sequence_number\": %"PRIu64"", sequence_number);
     byteread_vint(s, &retire_before);
-    fprintf(f, ", \"retire_before\": %"PRIu64"", retire_before);
+    qlog_printf(f, ", \"retire_before\": %"PRIu64"", retire_before);
     byteread_vint(s, &cid_length);
-    fprintf(f, ", \"connection_id\": ");
+    qlog_puts(f, ", \"connection_id\": ");
     qlog_string(f, s, cid_length);
-    fprintf(f, ", \"reset_token\": ");
+    qlog_puts(f, ", \"reset_token\": ");
     qlog_string(f, s, 16);
 }
 
-void qlog_retire_connection_id_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_retire_connection_id_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     uint64_t sequence_number = 0;
 
     if (ftype == picoquic_frame_type_path_retire_connection_id) {
         uint64_t path_id = 0;
         byteread_vint(s, &path_id);
-        fprintf(f, ", \"path_id\": %"PRIu64"", path_id);
+        qlog_printf(f, ", \"path_id\": %"PRIu64"", path_id);
     }
 
     byteread_vint(s, &sequence_number);
-    fprintf(f, ", \"sequence_number\": %"PRIu64"", sequence_number);
+    qlog_printf(f, ", \"sequence_number\": %"PRIu64"", sequence_number);
 }
 
-void qlog_new_token_frame(FILE* f, bytestream* s)
+void qlog_new_token_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t toklen = 0;
 
-    fprintf(f, ", \"new_token\": ");
+    qlog_puts(f, ", \"new_token\": ");
     byteread_vint(s, &toklen);
     qlog_string(f, s, toklen);
 }
 
-void qlog_path_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_path_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     if (ftype == picoquic_frame_type_path_challenge) {
-        fprintf(f, ", \"path_challenge\": ");
+        qlog_puts(f, ", \"path_challenge\": ");
     }
     else {
-        fprintf(f, ", \"path_response\": ");
+        qlog_puts(f, ", \"path_response\": ");
     }
     qlog_string(f, s, 8);
 }
 
-void qlog_crypto_hs_frame(FILE* f, bytestream* s)
+void qlog_crypto_hs_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t offset = 0;
     uint64_t data_length = 0;
 
 
     byteread_vint(s, &offset);
-    fprintf(f, ", \"offset\": %"PRIu64"", offset);
+    qlog_printf(f, ", \"offset\": %"PRIu64"", offset);
     byteread_vint(s, &data_length);
-    fprintf(f, ", \"length\": %"PRIu64"", data_length);
+    qlog_printf(f, ", \"length\": %"PRIu64"", data_length);
 }
 
-void qlog_datagram_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_datagram_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     unsigned int has_length = ftype & 1;
     uint64_t length = 0;
 
     if (has_length) {
         byteread_vint(s, &length);
-        fprintf(f, ", \"length\": %"PRIu64"", length);
+        qlog_printf(f, ", \"length\": %"PRIu64"", length);
     }
 }
 
-void qlog_ack_frequency_frame(FILE* f, bytestream* s)
+void qlog_ack_frequency_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t sequence_number = 0;
     uint64_t packet_tolerance = 0;
     uint64_t max_ack_delay = 0;
     uint64_t reordering_threshold = 0;
     byteread_vint(s, &sequence_number);
-    fprintf(f, ", \"sequence_number\": %"PRIu64"", sequence_number);
+    qlog_printf(f, ", \"sequence_number\": %"PRIu64"", sequence_number);
     byteread_vint(s, &packet_tolerance);
-    fprintf(f, ", \"packet_tolerance\": %"PRIu64"", packet_tolerance);
+    qlog_printf(f, ", \"packet_tolerance\": %"PRIu64"", packet_tolerance);
     byteread_vint(s, &max_ack_delay);
-    fprintf(f, ", \"max_ack_delay\": %"PRIu64"", max_ack_delay);
+    qlog_printf(f, ", \"max_ack_delay\": %"PRIu64"", max_ack_delay);
     byteread_vint(s, &reordering_threshold);
-    fprintf(f, ", \"reordering_threshold\": %"PRIu64"", reordering_threshold);
+    qlog_printf(f, ", \"reordering_threshold\": %"PRIu64"", reordering_threshold);
 }
 
-void qlog_ack_frame(uint64_t ftype, FILE * f, bytestream* s)
+void qlog_ack_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     uint64_t largest = 0;
     uint64_t ack_delay = 0;
@@ -1071,13 +1191,13 @@ void qlog_ack_frame(uint64_t ftype, FILE * f, bytestream* s)
     uint64_t path_id = 0;
     if (ftype == picoquic_frame_type_path_ack || ftype == picoquic_frame_type_path_ack_ecn) {
         byteread_vint(s, &path_id);
-        fprintf(f, ", \"path_id\": %"PRIu64"", path_id);
+        qlog_printf(f, ", \"path_id\": %"PRIu64"", path_id);
     }
     byteread_vint(s, &largest);
     byteread_vint(s, &ack_delay);
-    fprintf(f, ", \"ack_delay\": %"PRIu64"", ack_delay);
+    qlog_printf(f, ", \"ack_delay\": %"PRIu64"", ack_delay);
     byteread_vint(s, &num);
-    fprintf(f, ", \"acked_ranges\": [");
+    qlog_puts(f, ", \"acked_ranges\": [");
     for (uint64_t i = 0; i <= num; i++) {
         uint64_t skip = 0;
         int64_t start_range;
@@ -1088,67 +1208,67 @@ void qlog_ack_frame(uint64_t ftype, FILE * f, bytestream* s)
             skip++;
 
             largest -= skip;
-            fprintf(f, ", ");
+            qlog_puts(f, ", ");
         }
         uint64_t range = 0;
         byteread_vint(s, &range);
 
         start_range = largest - range;
         end_range = (int64_t)largest;
-        fprintf(f, "[%"PRId64", %"PRId64"]", start_range, end_range);
+        qlog_printf(f, "[%"PRId64", %"PRId64"]", start_range, end_range);
 
         largest -= range + 1;
     }
-    fprintf(f, "]");
+    qlog_puts(f, "]");
     if (ftype == picoquic_frame_type_ack_ecn || ftype == picoquic_frame_type_path_ack_ecn) {
         char const* ecn_name[3] = { "ect0", "ect1", "ce" };
         for (int ecnx = 0; ecnx < 3; ecnx++) {
             uint64_t ecn_v = 0;
             byteread_vint(s, &ecn_v);
-            fprintf(f, ", \"%s\": %"PRIu64, ecn_name[ecnx], ecn_v);
+            qlog_printf(f, ", \"%s\": %"PRIu64, ecn_name[ecnx], ecn_v);
         }
     }
 }
 
-void qlog_erroring_frame(FILE* f, bytestream* s, uint64_t ftype)
+void qlog_erroring_frame(qlog_out_t* f, bytestream* s, uint64_t ftype)
 {
     size_t extra_bytes = s->size - s->ptr;
 
-    fprintf(f, ",\"unknown_type\": %" PRIu64 ",", ftype);
+    qlog_printf(f, ",\"unknown_type\": %" PRIu64 ",", ftype);
 
-    fprintf(f, "\"begins_with\": ");
+    qlog_puts(f, "\"begins_with\": ");
 
     qlog_string(f, s, (extra_bytes > 8) ? 8 : extra_bytes);
 }
 
-int qlog_proposed_versions(FILE* f, bytestream* s)
+int qlog_proposed_versions(qlog_out_t* f, bytestream* s)
 {
     int nb_versions = 0;
-    fprintf(f, ",\n    \"proposed_versions\": [");
+    qlog_puts(f, ",\n    \"proposed_versions\": [");
 
     while (bytestream_remain(s) > 0) {
         if (nb_versions > 0) {
-            fprintf(f, ", ");
+            qlog_puts(f, ", ");
         }
         qlog_string(f, s, 4);
         nb_versions++;
     }
-    fprintf(f, "]");
+    qlog_puts(f, "]");
     return 0;
 }
 
-int qlog_retry_token(FILE* f, bytestream* s)
+int qlog_retry_token(qlog_out_t* f, bytestream* s)
 {
     size_t l = bytestream_remain(s);
 
     if (l > 0) {
-        fprintf(f, ",\n    \"retry_token\": ");
+        qlog_puts(f, ",\n    \"retry_token\": ");
         qlog_string(f, s, l);
     }
     return 0;
 }
 
-void qlog_bdp_frame(FILE* f, bytestream* s)
+void qlog_bdp_frame(qlog_out_t* f, bytestream* s)
 {
     uint64_t lifetime = 0;
     uint64_t recon_bytes_in_flight = 0;
@@ -1159,24 +1279,39 @@ void qlog_bdp_frame(FILE* f, bytestream* s)
     byteread_vint(s, &recon_bytes_in_flight);
     byteread_vint(s, &recon_min_rtt);
     byteread_vint(s, &ip_len);
-    fprintf(f, ", \"lifetime\": %"PRIu64", \"bytes_in_flight\": %"PRIu64", \"min_rtt\": %"PRIu64", \"ip\": ", lifetime, recon_bytes_in_flight, recon_min_rtt);
+    qlog_printf(f, ", \"lifetime\": %"PRIu64", \"bytes_in_flight\": %"PRIu64", \"min_rtt\": %"PRIu64", \"ip\": ", lifetime, recon_bytes_in_flight, recon_min_rtt);
     qlog_string(f, s, ip_len);
 }
 
-void qlog_observed_address_frame(uint64_t ftype, FILE* f, bytestream* s)
+void qlog_fec_repair_frame(qlog_out_t* f, bytestream* s)
+{
+    uint64_t first_pn = 0;
+    uint64_t pn_mask = 0;
+    uint64_t length_xor = 0;
+    uint64_t symbol_length = 0;
+
+    byteread_vint(s, &first_pn);
+    byteread_vint(s, &pn_mask);
+    byteread_vint(s, &length_xor);
+    byteread_vint(s, &symbol_length);
+    qlog_printf(f, ", \"first_pn\": %"PRIu64", \"pn_mask\": %"PRIu64", \"length_xor\": %"PRIu64", \"symbol_length\": %"PRIu64,
+        first_pn, pn_mask, length_xor, symbol_length);
+}
+
+void qlog_observed_address_frame(uint64_t ftype, qlog_out_t* f, bytestream* s)
 {
     unsigned int port = 0;
     uint64_t sequence = 0;
 
     byteread_vint(s, &sequence);
-    fprintf(f, ", \"sequence\": %"PRIu64", \"address\": \"", sequence);
+    qlog_printf(f, ", \"sequence\": %"PRIu64", \"address\": \"", sequence);
     if ((ftype & 1) == 0) {
         /* IPv4 address */
         for (int x = 0; x < 4 && s->ptr < s->size; x++) {
             if (x != 0) {
-                fprintf(f, ".");
+                qlog_puts(f, ".");
             }
-            fprintf(f, "%d", s->data[s->ptr++]);
+            qlog_printf(f, "%d", s->data[s->ptr++]);
         }
     }
     else {
@@ -1188,22 +1323,22 @@ void qlog_observed_address_frame(uint64_t ftype, FILE* f, bytestream* s)
                 w += s->data[s->ptr++];
             }
             if (x != 0) {
-                fprintf(f, ":");
+                qlog_puts(f, ":");
             }
-            fprintf(f, "%x", w);
+            qlog_printf(f, "%x", w);
         }
     }
     for (int y = 0; y < 2 && s->ptr < s->size; y++) {
         port <<= 8;
         port += s->data[s->ptr++];
     }
-    fprintf(f, "\", \"port\": %u", port);
+    qlog_printf(f, "\", \"port\": %u", port);
 }
 
 int qlog_packet_frame(bytestream * s, void * ptr)
 {
     qlog_context_t * ctx = (qlog_context_t*)ptr;
-    FILE * f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
 
     if (ctx->packet_type == picoquic_packet_version_negotiation) {
         return qlog_proposed_versions(f, s);
@@ -1213,16 +1348,16 @@ int qlog_packet_frame(bytestream * s, void * ptr)
     }
 
     if (ctx->frame_count != 0) {
-        fprintf(f, ", ");
+        qlog_puts(f, ", ");
     }
 
-    fprintf(f, "{ ");
+    qlog_puts(f, "{ ");
 
     uint64_t ftype = 0;
     size_t ptr_before_type = s->ptr;
     byteread_vint(s, &ftype);
 
-    fprintf(f, "\n    \"frame_type\": \"%s\"", ftype2str((picoquic_frame_type_enum_t)ftype));
+    qlog_frame_type(f, ctx, ftype);
 
     if (ftype >= picoquic_frame_type_stream_range_min &&
         ftype <= picoquic_frame_type_stream_range_max) {
@@ -1234,14 +1369,14 @@ int qlog_packet_frame(bytestream * s, void * ptr)
         }
         uint64_t length = 0;
         byteread_vint(s, &length);
-        fprintf(f, ", \"id\": %"PRIu64", \"offset\": %"PRIu64", \"length\": %"PRIu64", \"fin\": %s ",
+        qlog_printf(f, ", \"id\": %"PRIu64", \"offset\": %"PRIu64", \"length\": %"PRIu64", \"fin\": %s ",
             stream_id, offset, length, (ftype & 1) ? "true":"false");
         if ((ftype & 2) == 0) {
-            fprintf(f, ", \"has_length\": false");
+            qlog_puts(f, ", \"has_length\": false");
         }
         uint64_t extra_bytes = bytestream_remain(s);
         if (extra_bytes > 0) {
-            fprintf(f, ", \"begins_with\": ");
+            qlog_puts(f, ", \"begins_with\": ");
             qlog_string(f, s, extra_bytes);
         }
 
@@ -1343,13 +1478,16 @@ int qlog_packet_frame(bytestream * s, void * ptr)
     case picoquic_frame_type_observed_address_v6:
         qlog_observed_address_frame(ftype, f, s);
         break;
+    case picoquic_frame_type_fec_repair:
+        qlog_fec_repair_frame(f, s);
+        break;
     default:
         s->ptr = ptr_before_type;
         qlog_erroring_frame(f, s, ftype);
         break;
     }
 
-    fprintf(f, "}");
+    qlog_puts(f, "}");
     ctx->frame_count++;
     return 0;
 }
@@ -1357,14 +1495,14 @@ int qlog_packet_frame(bytestream * s, void * ptr)
 int qlog_packet_end(void * ptr)
 {
     qlog_context_t * ctx = (qlog_context_t*)ptr;
-    FILE * f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
 
     if (ctx->packet_type == picoquic_packet_version_negotiation ||
         ctx->packet_type == picoquic_packet_retry) {
-        fprintf(f, "}]");
+        qlog_puts(f, "}]");
     }
     else {
-        fprintf(f, "]}]");
+        qlog_puts(f, "]}]");
     }
 
     ctx->packet_count++; 
@@ -1407,7 +1545,7 @@ int qlog_cc_update(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
     uint64_t bytes_in_transit = 0;
     uint64_t app_limited = 0;
     qlog_context_t* ctx = (qlog_context_t*)ptr;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
 
     ret |= byteread_vint(s, &sequence);
     ret |= byteread_vint(s, &packet_rcvd);
@@ -1446,17 +1584,12 @@ int qlog_cc_update(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
         int64_t delta_time = time - ctx->start_time;
         char* comma = "";
 
-        if (ctx->event_count != 0) {
-            fprintf(f, ",\n");
-        }
-        else {
-            fprintf(f, "\n");
-        }
+                qlog_event_separator(f, ctx);
 
         qlog_event_header(f, ctx, delta_time, path_id, "recovery", "metrics_updated");
 
         if (cwin != ctx->cwin) {
-            fprintf(f, "%s\"cwnd\": %" PRIu64, comma, cwin);
+            qlog_printf(f, "%s\"cwnd\": %" PRIu64, comma, cwin);
             ctx->cwin = cwin;
             comma = ",";
         }
@@ -1464,41 +1597,41 @@ int qlog_cc_update(uint64_t time, uint64_t path_id, bytestream* s, void* ptr)
         if (pacing_packet_time != ctx->pacing_packet_time && pacing_packet_time > 0) {
             double bps = ((double)Send_MTU * 8) * 1000000.0 / pacing_packet_time;
             uint64_t bits_per_second = (uint64_t)bps;
-            fprintf(f, "%s\"pacing_rate\": %" PRIu64, comma, bits_per_second);
+            qlog_printf(f, "%s\"pacing_rate\": %" PRIu64, comma, bits_per_second);
             ctx->pacing_packet_time = pacing_packet_time;
             comma = ",";
         }
 
         if (bytes_in_transit != ctx->bytes_in_transit) {
-            fprintf(f, "%s\"bytes_in_flight\": %" PRIu64, comma, bytes_in_transit);
+            qlog_printf(f, "%s\"bytes_in_flight\": %" PRIu64, comma, bytes_in_transit);
             ctx->bytes_in_transit = bytes_in_transit;
             comma = ",";
         }
 
         if (SRTT != ctx->SRTT) {
-            fprintf(f, "%s\"smoothed_rtt\": %" PRIu64, comma, SRTT);
+            qlog_printf(f, "%s\"smoothed_rtt\": %" PRIu64, comma, SRTT);
             comma = ",";
         }
 
         if (RTT_min != ctx->RTT_min) {
-            fprintf(f, "%s\"min_rtt\": %" PRIu64, comma, RTT_min);
+            qlog_printf(f, "%s\"min_rtt\": %" PRIu64, comma, RTT_min);
             ctx->RTT_min = RTT_min;
             comma = ",";
         }
 
         if (rtt_sample != ctx->rtt_sample) {
-            fprintf(f, "%s\"latest_rtt\": %" PRIu64, comma, rtt_sample);
+            qlog_printf(f, "%s\"latest_rtt\": %" PRIu64, comma, rtt_sample);
             ctx->rtt_sample = rtt_sample;
             comma = ",";
         }
 
         if (app_limited != ctx->app_limited) {
-            fprintf(f, "%s\"app_limited\": %" PRIu64, comma, app_limited);
+            qlog_printf(f, "%s\"app_limited\": %" PRIu64, comma, app_limited);
             ctx->app_limited = (app_limited != 0);
             /* comma = ","; (not useful since last block of function) */
         }
 
-        fprintf(f, "}]");
+        qlog_puts(f, "}]");
         ctx->event_count++;
     }
 
@@ -1509,21 +1642,16 @@ int qlog_info_message(uint64_t time, bytestream* s, void* ptr)
 {
     int ret = 0;
     qlog_context_t* ctx = (qlog_context_t*)ptr;
-    FILE* f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
     int64_t delta_time = time - ctx->start_time;
     uint8_t message[BYTESTREAM_MAX_BUFFER_SIZE];
     size_t message_length = 0;
 
-    if (ctx->event_count != 0) {
-        fprintf(f, ",\n");
-    }
-    else {
-        fprintf(f, "\n");
-    }
+        qlog_event_separator(f, ctx);
 
     qlog_event_header(f, ctx, delta_time, 0, "info", "message");
 
-    fprintf(f, " \"message\": \"");
+    qlog_puts(f, " \"message\": \"");
     message_length = bytestream_remain(s);
     if (message_length > sizeof(message)) {
         message_length = sizeof(message);
@@ -1535,8 +1663,8 @@ int qlog_info_message(uint64_t time, bytestream* s, void* ptr)
             message[i] = '?';
         }
     }
-    fwrite(message, message_length, 1, f);
-    fprintf(f, "\"}]");
+    qlog_write(f, message, message_length);
+    qlog_puts(f, "\"}]");
     ctx->event_count++;
 
     return ret;
@@ -1546,7 +1674,7 @@ int qlog_connection_start(uint64_t time, const picoquic_connection_id_t * cid, i
     uint32_t proposed_version, const picoquic_connection_id_t * remote_cnxid, void * ptr)
 {
     qlog_context_t * ctx = (qlog_context_t*)ptr;
-    FILE * f = ctx->f_txtlog;
+    qlog_out_t* f = &ctx->out;
 
     ctx->start_time = time;
     ctx->packet_count = 0;
@@ -1571,19 +1699,29 @@ int qlog_connection_start(uint64_t time, const picoquic_connection_id_t * cid, i
     ctx->spin_bit_sent_last = 0;
     ctx->spin_bit_sent = 0;
 
-    fprintf(f, "{ \"qlog_version\": \"draft-00\", \"title\": \"picoquic\", \"traces\": [\n");
-    fprintf(f, "{ \"vantage_point\": { \"name\": \"backend-67\", \"type\": \"%s\" },\n",
+    if (ctx->is_json_seq) {
+        qlog_puts(f, "\x1e{ \"qlog_version\": \"0.3\", \"qlog_format\": \"JSON-SEQ\", \"title\": \"picoquic\", \"trace\": ");
+    }
+    else {
+        qlog_puts(f, "{ \"qlog_version\": \"draft-00\", \"title\": \"picoquic\", \"traces\": [\n");
+    }
+    qlog_printf(f, "{ \"vantage_point\": { \"name\": \"backend-67\", \"type\": \"%s\" },\n",
         client_mode?"client":"server");
 
-    fprintf(f, "\"title\": \"picoquic\", \"description\": \"%s\",", ctx->cid_name);
+    qlog_printf(f, "\"title\": \"picoquic\", \"description\": \"%s\",", ctx->cid_name);
     if (ctx->trace_flow_id) {
-        fprintf(f, "\"event_fields\": [\"relative_time\", \"path_id\", \"category\", \"event\", \"data\"],\n");
+        qlog_puts(f, "\"event_fields\": [\"relative_time\", \"path_id\", \"category\", \"event\", \"data\"],\n");
     } else {
-        fprintf(f, "\"event_fields\": [\"relative_time\", \"category\", \"event\", \"data\"],\n");
+        qlog_puts(f, "\"event_fields\": [\"relative_time\", \"category\", \"event\", \"data\"],\n");
+    }
+    qlog_puts(f, "\"configuration\": {\"time_units\": \"us\"},\n");
+    if (ctx->is_json_seq) {
+        qlog_printf(f, "\"common_fields\": { \"protocol_type\": \"QUIC_HTTP3\", \"reference_time\": \"%"PRIu64"\"}}}", ctx->start_time);
+    }
+    else {
+        qlog_printf(f, "\"common_fields\": { \"protocol_type\": \"QUIC_HTTP3\", \"reference_time\": \"%"PRIu64"\"},\n", ctx->start_time);
+        qlog_puts(f, "\"events\": [");
     }
-    fprintf(f, "\"configuration\": {\"time_units\": \"us\"},\n");
-    fprintf(f, "\"common_fields\": { \"protocol_type\": \"QUIC_HTTP3\", \"reference_time\": \"%"PRIu64"\"},\n", ctx->start_time);
-    fprintf(f, "\"events\": [");
     ctx->state = 1;
     return 0;
 }
@@ -1591,14 +1729,76 @@ int qlog_connection_start(uint64_t time, const picoquic_connection_id_t * cid, i
 int qlog_connection_end(uint64_t time, void * ptr)
 {
     qlog_context_t * ctx = (qlog_context_t*)ptr;
-    FILE * f = ctx->f_txtlog;
-    fprintf(f, "]}]}\n");
+    qlog_out_t* f = &ctx->out;
+    qlog_puts(f, (ctx->is_json_seq) ? "\n" : "]}]}\n");
 
     ctx->state = 2;
     return 0;
 }
 
-int qlog_convert(const picoquic_connection_id_t* cid, FILE* f_binlog, const char* binlog_name, const char* txt_name, const char* out_dir, uint16_t flags)
+static qlog_context_t* qlog_context_create(FILE* f_txtlog, const picoquic_connection_id_t* cid, uint16_t flags, int is_json_seq)
+{
+    qlog_context_t* ctx = (qlog_context_t*)malloc(sizeof(qlog_context_t));
+
+    if (ctx != NULL) {
+        memset(ctx, 0, sizeof(qlog_context_t));
+        if (picoquic_print_connection_id_hexa(ctx->cid_text, sizeof(ctx->cid_text), cid) != 0) {
+            free(ctx);
+            ctx = NULL;
+        }
+        else {
+            ctx->f_txtlog = f_txtlog;
+            ctx->out.f = f_txtlog;
+            ctx->cid_name = ctx->cid_text;
+            ctx->start_time = 0;
+            ctx->packet_count = 0;
+            ctx->state = 0;
+            ctx->trace_flow_id = (flags & 1) ? 1 : 0;
+            ctx->is_json_seq = (is_json_seq) ? 1 : 0;
+            qlog_frame_name_init(ctx);
+        }
+    }
+
+    return ctx;
+}
+
+/* Write the end of the trace if the log did not include the connection
+ * close, then write the buffered text and close the file */
+static int qlog_context_close(qlog_context_t* ctx)
+{
+    int ret;
+
+    if (ctx->state == 1) {
+        qlog_connection_end(0, ctx);
+    }
+    qlog_flush(&ctx->out);
+    ret = (ctx->out.is_error) ? -1 : 0;
+    (void)picoquic_file_close(ctx->f_txtlog);
+    free(ctx);
+
+    return ret;
+}
+
+static void qlog_set_callbacks(binlog_convert_cb_t* callbacks, qlog_context_t* ctx)
+{
+    callbacks->connection_start = qlog_connection_start;
+    callbacks->connection_end = qlog_connection_end;
+    callbacks->alpn_update = qlog_alpn_update;
+    callbacks->param_update = qlog_param_update;
+    callbacks->pdu = qlog_pdu;
+    callbacks->packet_start = qlog_packet_start;
+    callbacks->packet_frame = qlog_packet_frame;
+    callbacks->packet_end = qlog_packet_end;
+    callbacks->packet_lost = qlog_packet_lost;
+    callbacks->packet_dropped = qlog_packet_dropped;
+    callbacks->packet_buffered = qlog_packet_buffered;
+    callbacks->cc_update = qlog_cc_update;
+    callbacks->info_message = qlog_info_message;
+    callbacks->ptr = ctx;
+}
+
+static int qlog_convert_ex(const picoquic_connection_id_t* cid, FILE* f_binlog, const binlog_index_t* index,
+    const char* binlog_name, const char* txt_name, const char* out_dir, uint16_t flags)
 {
     int ret = 0;
     FILE* f_txtlog = NULL;
@@ -1619,42 +1819,91 @@ int qlog_convert(const picoquic_connection_id_t* cid, FILE* f_binlog, const char
         ret = -1;
     }
     else  if (ret == 0) {
+        qlog_context_t* qlog = qlog_context_create(f_txtlog, cid, flags, 0);
 
-        qlog_context_t qlog;
-
-        memset(&qlog, 0, sizeof(qlog_context_t));
-
-        qlog.f_txtlog = f_txtlog;
-        qlog.cid_name = cid_name;
-        qlog.start_time = 0;
-        qlog.packet_count = 0;
-        qlog.state = 0;
-        qlog.trace_flow_id = (flags & 1) ? 1 : 0;
-
-        binlog_convert_cb_t ctx;
-        ctx.connection_start = qlog_connection_start;
-        ctx.connection_end = qlog_connection_end;
-        ctx.alpn_update = qlog_alpn_update;
-        ctx.param_update = qlog_param_update;
-        ctx.pdu = qlog_pdu;
-        ctx.packet_start = qlog_packet_start;
-        ctx.packet_frame = qlog_packet_frame;
-        ctx.packet_end = qlog_packet_end;
-        ctx.packet_lost = qlog_packet_lost;
-        ctx.packet_dropped = qlog_packet_dropped;
-        ctx.packet_buffered = qlog_packet_buffered;
-        ctx.cc_update = qlog_cc_update;
-        ctx.info_message = qlog_info_message;
-        ctx.ptr = &qlog;
-
-        ret = binlog_convert(f_binlog, cid, &ctx);
-
-        if (qlog.state == 1) {
-            qlog_connection_end(0, &qlog);
+        if (qlog == NULL) {
+            (void)picoquic_file_close(f_txtlog);
+            ret = -1;
         }
+        else {
+            binlog_convert_cb_t ctx;
+            int close_ret;
+
+            qlog_set_callbacks(&ctx, qlog);
+
+            if (index != NULL) {
+                ret = binlog_index_convert(index, cid, &ctx);
+            }
+            else {
+                ret = binlog_convert(f_binlog, cid, &ctx);
+            }
 
-        picoquic_file_close(f_txtlog);
+            close_ret = qlog_context_close(qlog);
+            if (ret == 0) {
+                ret = close_ret;
+            }
+        }
     }
 
     return ret;
 }
+
+int qlog_convert(const picoquic_connection_id_t* cid, FILE* f_binlog, const char* binlog_name, const char* txt_name, const char* out_dir, uint16_t flags)
+{
+    return qlog_convert_ex(cid, f_binlog, NULL, binlog_name, txt_name, out_dir, flags);
+}
+
+int qlog_convert_indexed(const picoquic_connection_id_t* cid, const binlog_index_t* index, const char* binlog_name, const char* txt_name, const char* out_dir, uint16_t flags)
+{
+    return qlog_convert_ex(cid, NULL, index, binlog_name, txt_name, out_dir, flags);
+}
+
+/*
+ * Streaming conversion. The records are converted one at a time, as they
+ * are produced, instead of being read back from the binary log file.
+ */
+typedef struct st_qlog_stream_t {
+    picoquic_connection_id_t cid;
+    qlog_context_t* ctx;
+    binlog_convert_cb_t callbacks;
+} qlog_stream_t;
+
+qlog_stream_t* qlog_stream_open(const picoquic_connection_id_t* cid, const char* txt_name, uint16_t flags, int is_json_seq)
+{
+    qlog_stream_t* stream = (qlog_stream_t*)malloc(sizeof(qlog_stream_t));
+
+    if (stream != NULL) {
+        FILE* f_txtlog = picoquic_file_open(txt_name, "w");
+
+        memset(stream, 0, sizeof(qlog_stream_t));
+        if (f_txtlog == NULL) {
+            free(stream);
+            stream = NULL;
+        }
+        else if ((stream->ctx = qlog_context_create(f_txtlog, cid, flags, is_json_seq)) == NULL) {
+            (void)picoquic_file_close(f_txtlog);
+            free(stream);
+            stream = NULL;
+        }
+        else {
+            stream->cid = *cid;
+            qlog_set_callbacks(&stream->callbacks, stream->ctx);
+        }
+    }
+
+    return stream;
+}
+
+int qlog_stream_record(qlog_stream_t* stream, const uint8_t* bytes, size_t length)
+{
+    return binlog_convert_record(bytes, length, &stream->cid, &stream->callbacks);
+}
+
+int qlog_stream_close(qlog_stream_t* stream)
+{
+    int ret = qlog_context_close(stream->ctx);
+
+    free(stream);
+
+    return ret;
+}
@@ -28,6 +28,8 @@
 extern "C" {
 #endif
 
+struct st_binlog_index_t;
+
 int qlog_packet_start(uint64_t time, uint64_t size, const picoquic_packet_header * ph, int rxtx, void * ptr);
 int qlog_packet_frame(bytestream * s, void * ptr);
 int qlog_packet_end(void * ptr);
@@ -36,6 +38,21 @@ int qlog_connection_start(uint64_t time, const picoquic_connection_id_t * cid, i
 int qlog_connection_end(uint64_t time, void * ptr);
 
 int qlog_convert(const picoquic_connection_id_t* cid, FILE * f_binlog, const char * binlog_name, const char* txt_name, const char * out_dir, uint16_t flags);
+/* Same as qlog_convert, reading the events from an index created with
+ * binlog_index_open. Can be called from several threads at once. */
+int qlog_convert_indexed(const picoquic_connection_id_t* cid, const struct st_binlog_index_t* index, const char* binlog_name, const char* txt_name, const char* out_dir, uint16_t flags);
+
+/* Streaming conversion: the binary log records of a connection are passed
+ * one at a time, as they are produced, and the text is written to txt_name
+ * through a large memory buffer. If is_json_seq is set, the output uses the
+ * JSON-SEQ format, with one record per event, which can be read while the
+ * connection is still active. */
+typedef struct st_qlog_stream_t qlog_stream_t;
+
+qlog_stream_t* qlog_stream_open(const picoquic_connection_id_t* cid, const char* txt_name, uint16_t flags, int is_json_seq);
+/* bytes and length describe a single record, without the length prefix */
+int qlog_stream_record(qlog_stream_t* stream, const uint8_t* bytes, size_t length);
+int qlog_stream_close(qlog_stream_t* stream);
 
 #ifdef __cplusplus
 }
@@ -30,6 +30,8 @@
 extern "C" {
 #endif
 
+struct st_binlog_index_t;
+
 typedef struct svg_context_st {
 
     FILE * f_txtlog;      /*!< The file handle of the opened output file. */
@@ -53,6 +55,9 @@ int svg_packet_frame(bytestream * s, void * ptr);
 int svg_packet_end(void * ptr);
 
 int svg_convert(const picoquic_connection_id_t * cid, FILE * f_binlog, FILE * f_template, const char * binlog_name, const char * out_dir);
+/* Same as svg_convert, reading the events from an index created with
+ * binlog_index_open. Parallel conversions must each use their own template file handle. */
+int svg_convert_indexed(const picoquic_connection_id_t* cid, const struct st_binlog_index_t* index, FILE* f_template, const char* binlog_name, const char* out_dir);
 
 #ifdef __cplusplus
 }
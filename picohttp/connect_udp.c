@@ -0,0 +1,527 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* CONNECT-UDP proxy, see connect_udp.h for the design.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* Required for recvmmsg */
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <picoquic.h>
+#include "picoquic_utils.h"
+#include "picosocks.h"
+#include "h3zero_common.h"
+#include "connect_udp.h"
+#ifndef _WINDOWS
+#include <fcntl.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define CONNECT_UDP_USE_MMSG
+#endif
+
+connect_udp_proxy_t* connect_udp_proxy_create(size_t max_flows, uint64_t rate, uint64_t burst)
+{
+    connect_udp_proxy_t* proxy = (connect_udp_proxy_t*)malloc(sizeof(connect_udp_proxy_t));
+
+    if (proxy != NULL) {
+        memset(proxy, 0, sizeof(connect_udp_proxy_t));
+        proxy->max_flows = (max_flows == 0) ? CONNECT_UDP_DEFAULT_MAX_FLOWS : max_flows;
+        proxy->rate = rate;
+        proxy->burst = (burst == 0 && rate > 0) ? rate / 10 + CONNECT_UDP_PAYLOAD_MAX : burst;
+    }
+    return proxy;
+}
+
+static void connect_udp_flow_delete(connect_udp_flow_t* flow)
+{
+    connect_udp_proxy_t* proxy = flow->proxy;
+
+    if (flow->previous == NULL) {
+        proxy->first = flow->next;
+    }
+    else {
+        flow->previous->next = flow->next;
+    }
+    if (flow->next == NULL) {
+        proxy->last = flow->previous;
+    }
+    else {
+        flow->next->previous = flow->previous;
+    }
+    if (proxy->nb_flows > 0) {
+        proxy->nb_flows--;
+    }
+    if (flow->fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(flow->fd);
+    }
+    h3zero_release_capsule(&flow->capsule);
+    free(flow);
+}
+
+void connect_udp_proxy_delete(connect_udp_proxy_t* proxy)
+{
+    if (proxy != NULL) {
+        while (proxy->first != NULL) {
+            connect_udp_flow_delete(proxy->first);
+        }
+        free(proxy);
+    }
+}
+
+int connect_udp_rate_check(connect_udp_rate_t* rate_ctx, size_t length, uint64_t current_time)
+{
+    int is_allowed = 1;
+
+    if (rate_ctx->rate > 0) {
+        if (current_time > rate_ctx->last_time) {
+            uint64_t delta_t = current_time - rate_ctx->last_time;
+            uint64_t added = (delta_t >= 1000000) ? rate_ctx->burst : (delta_t * rate_ctx->rate) / 1000000;
+
+            if (added > 0) {
+                /* Only move the clock when tokens are added, so that low rates still progress */
+                rate_ctx->tokens = (rate_ctx->tokens + added > rate_ctx->burst) ? rate_ctx->burst : rate_ctx->tokens + added;
+                rate_ctx->last_time = current_time;
+            }
+        }
+        if (rate_ctx->tokens >= length) {
+            rate_ctx->tokens -= length;
+        }
+        else {
+            is_allowed = 0;
+        }
+    }
+    return is_allowed;
+}
+
+int connect_udp_parse_path(const uint8_t* path, size_t path_length, struct sockaddr_storage* target)
+{
+    int ret = -1;
+    size_t prefix_length = strlen(CONNECT_UDP_PATH);
+
+    if (path != NULL && path_length > prefix_length && memcmp(path, CONNECT_UDP_PATH, prefix_length) == 0) {
+        char host[64];
+        size_t host_length = 0;
+        size_t i = prefix_length;
+        int is_valid = 1;
+
+        /* Host, with percent-encoded colons */
+        while (is_valid && i < path_length && path[i] != '/') {
+            char c = (char)path[i++];
+            if (c == '%') {
+                if (i + 2 <= path_length && path[i] == '3' && (path[i + 1] == 'A' || path[i + 1] == 'a')) {
+                    c = ':';
+                    i += 2;
+                }
+                else {
+                    is_valid = 0;
+                }
+            }
+            if (host_length + 1 >= sizeof(host)) {
+                is_valid = 0;
+            }
+            else {
+                host[host_length++] = c;
+            }
+        }
+        host[host_length] = 0;
+
+        /* Port, followed by the end of the path, a slash, or a query */
+        if (is_valid && host_length > 0 && i < path_length && path[i] == '/') {
+            uint32_t port = 0;
+            size_t nb_digits = 0;
+
+            i++;
+            while (i < path_length && path[i] >= '0' && path[i] <= '9' && nb_digits < 6) {
+                port = 10 * port + (path[i] - '0');
+                nb_digits++;
+                i++;
+            }
+            if (nb_digits > 0 && port > 0 && port <= 0xFFFF &&
+                (i == path_length || path[i] == '/' || path[i] == '?') &&
+                picoquic_store_text_addr(target, host, htons((uint16_t)port)) == 0) {
+                ret = 0;
+            }
+        }
+    }
+    return ret;
+}
+
+/* Close a flow from one of its stream events. The prefix is removed without
+ * raising the deregister event, since the flow is freed here. */
+static void connect_udp_flow_close(picoquic_cnx_t* cnx, connect_udp_flow_t* flow, h3zero_stream_ctx_t* stream_ctx)
+{
+    h3zero_stream_prefix_t* prefix_ctx = h3zero_find_stream_prefix(flow->h3_ctx, flow->stream_id);
+
+    if (stream_ctx != NULL) {
+        stream_ctx->path_callback = NULL;
+        stream_ctx->path_callback_ctx = NULL;
+    }
+    if (prefix_ctx != NULL) {
+        prefix_ctx->function_call = NULL;
+        h3zero_delete_stream_prefix(cnx, flow->h3_ctx, flow->stream_id);
+    }
+    connect_udp_flow_delete(flow);
+}
+
+static SOCKET_TYPE connect_udp_open_socket(struct sockaddr_storage* target)
+{
+    SOCKET_TYPE fd = socket(target->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (fd != INVALID_SOCKET) {
+        int ret;
+#ifdef _WINDOWS
+        u_long non_blocking = 1;
+        ret = ioctlsocket(fd, FIONBIO, &non_blocking);
+#else
+        int flags = fcntl(fd, F_GETFL, 0);
+        ret = (flags < 0) ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+        /* A connected socket only receives from the target */
+        if (ret != 0 || connect(fd, (struct sockaddr*)target, picoquic_addr_length((struct sockaddr*)target)) != 0) {
+            SOCKET_CLOSE(fd);
+            fd = INVALID_SOCKET;
+        }
+    }
+    return fd;
+}
+
+static int connect_udp_accept(picoquic_cnx_t* cnx, uint8_t* path, size_t path_length,
+    h3zero_stream_ctx_t* stream_ctx, connect_udp_proxy_t* proxy)
+{
+    int ret = 0;
+    h3zero_callback_ctx_t* h3_ctx = (h3zero_callback_ctx_t*)picoquic_get_callback_context(cnx);
+    h3zero_header_parts_t* header = &stream_ctx->ps.stream_state.header;
+    connect_udp_flow_t* flow = NULL;
+    struct sockaddr_storage target;
+
+    if (proxy == NULL || h3_ctx == NULL || header->protocol == NULL ||
+        header->protocol_length != strlen(CONNECT_UDP_PROTOCOL) ||
+        memcmp(header->protocol, CONNECT_UDP_PROTOCOL, header->protocol_length) != 0) {
+        picoquic_log_app_message(cnx, "Connect UDP, unexpected protocol on stream %" PRIu64, stream_ctx->stream_id);
+        ret = -1;
+    }
+    else if (proxy->nb_flows >= proxy->max_flows) {
+        picoquic_log_app_message(cnx, "Connect UDP, too many flows, refusing stream %" PRIu64, stream_ctx->stream_id);
+        proxy->nb_flows_refused++;
+        ret = -1;
+    }
+    else if (connect_udp_parse_path(path, path_length, &target) != 0) {
+        picoquic_log_app_message(cnx, "Connect UDP, cannot parse target on stream %" PRIu64, stream_ctx->stream_id);
+        ret = -1;
+    }
+    else if ((flow = (connect_udp_flow_t*)malloc(sizeof(connect_udp_flow_t))) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(flow, 0, sizeof(connect_udp_flow_t));
+        flow->proxy = proxy;
+        flow->cnx = cnx;
+        flow->h3_ctx = h3_ctx;
+        flow->stream_id = stream_ctx->stream_id;
+        flow->target = target;
+        flow->to_target.rate = proxy->rate;
+        flow->to_target.burst = proxy->burst;
+        flow->to_target.tokens = proxy->burst;
+        flow->to_client = flow->to_target;
+        flow->fd = connect_udp_open_socket(&target);
+        flow->previous = proxy->last;
+        if (proxy->last == NULL) {
+            proxy->first = flow;
+        }
+        else {
+            proxy->last->next = flow;
+        }
+        proxy->last = flow;
+        proxy->nb_flows++;
+
+        if (flow->fd == INVALID_SOCKET ||
+            h3zero_declare_stream_prefix(h3_ctx, stream_ctx->stream_id, connect_udp_callback, flow) != 0) {
+            picoquic_log_app_message(cnx, "Connect UDP, cannot open flow on stream %" PRIu64, stream_ctx->stream_id);
+            connect_udp_flow_delete(flow);
+            ret = -1;
+        }
+        else {
+            stream_ctx->path_callback = connect_udp_callback;
+            stream_ctx->path_callback_ctx = flow;
+        }
+    }
+    return ret;
+}
+
+/* Send a UDP payload to the target. The payload is sent from the buffer in
+ * which it was received, there is no copy. */
+static void connect_udp_send_to_target(connect_udp_flow_t* flow, const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    if (!connect_udp_rate_check(&flow->to_target, length, current_time) ||
+        send(flow->fd, (const char*)bytes, (int)length, 0) != (int)length) {
+        flow->nb_dropped++;
+        flow->proxy->nb_dropped++;
+    }
+    else {
+        flow->nb_sent_to_target++;
+        flow->proxy->nb_sent_to_target++;
+    }
+}
+
+/* The HTTP Datagram payload starts with the context ID */
+static void connect_udp_receive_datagram(connect_udp_flow_t* flow, const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    uint64_t context_id = UINT64_MAX;
+    const uint8_t* bytes_max = bytes + length;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &context_id)) == NULL ||
+        context_id != CONNECT_UDP_CONTEXT_ID_PAYLOAD) {
+        /* Unknown context, drop silently */
+        flow->nb_dropped++;
+        flow->proxy->nb_dropped++;
+    }
+    else {
+        connect_udp_send_to_target(flow, bytes, bytes_max - bytes, current_time);
+    }
+}
+
+/* Capsules arrive in the DATA frames of the request stream. */
+static int connect_udp_receive_capsules(picoquic_cnx_t* cnx, connect_udp_flow_t* flow, const uint8_t* bytes, size_t length,
+    uint64_t current_time)
+{
+    int ret = 0;
+    const uint8_t* bytes_max = bytes + length;
+
+    while (ret == 0 && bytes != NULL && bytes < bytes_max) {
+        bytes = h3zero_accumulate_capsule(bytes, bytes_max, &flow->capsule);
+        if (bytes == NULL) {
+            picoquic_log_app_message(cnx, "Connect UDP, cannot parse capsules on stream %" PRIu64, flow->stream_id);
+            ret = -1;
+        }
+        else if (flow->capsule.is_stored && flow->capsule.capsule_type == h3zero_capsule_type_datagram) {
+            connect_udp_receive_datagram(flow, flow->capsule.capsule_value, flow->capsule.capsule_length, current_time);
+        }
+        /* Other capsule types are ignored */
+    }
+    return ret;
+}
+
+/* Copy the oldest payload of the ring into the packet, after the context ID.
+ * Payloads that do not fit in a packet as large as any seen so far are dropped. */
+static int connect_udp_provide_datagram(connect_udp_flow_t* flow, void* context, size_t space)
+{
+    int ret = 0;
+
+    if (space > flow->largest_space) {
+        flow->largest_space = space;
+    }
+    while (flow->ring_count > 0 && flow->ring[flow->ring_first].length == 0) {
+        /* Slot of a payload dropped by the rate limiter */
+        flow->ring_first = (flow->ring_first + 1) % CONNECT_UDP_RING_DEPTH;
+        flow->ring_count--;
+    }
+    if (flow->ring_count > 0) {
+        connect_udp_slot_t* slot = &flow->ring[flow->ring_first];
+        size_t needed = slot->length + 1;
+
+        if (needed > space) {
+            if (space >= flow->largest_space) {
+                flow->nb_dropped++;
+                flow->proxy->nb_dropped++;
+                slot->length = 0;
+            }
+            (void)h3zero_provide_datagram_buffer(context, 0, 1);
+        }
+        else {
+            uint8_t* buffer = h3zero_provide_datagram_buffer(context, needed, flow->ring_count > 1);
+
+            if (buffer == NULL) {
+                ret = -1;
+            }
+            else {
+                buffer[0] = CONNECT_UDP_CONTEXT_ID_PAYLOAD;
+                memcpy(buffer + 1, slot->buffer, slot->length);
+                flow->ring_first = (flow->ring_first + 1) % CONNECT_UDP_RING_DEPTH;
+                flow->ring_count--;
+                flow->nb_sent_to_client++;
+                flow->proxy->nb_sent_to_client++;
+            }
+        }
+    }
+    return ret;
+}
+
+#ifdef CONNECT_UDP_USE_MMSG
+/* Receive a batch of payloads in the free slots from first_slot to the end of the ring */
+static int connect_udp_recv_batch(connect_udp_flow_t* flow, size_t first_slot, size_t nb_slots)
+{
+    struct mmsghdr msgs[CONNECT_UDP_RING_DEPTH];
+    struct iovec iovs[CONNECT_UDP_RING_DEPTH];
+    int nb_msg;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * nb_slots);
+    for (size_t i = 0; i < nb_slots; i++) {
+        iovs[i].iov_base = flow->ring[first_slot + i].buffer;
+        iovs[i].iov_len = CONNECT_UDP_PAYLOAD_MAX;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    nb_msg = recvmmsg(flow->fd, msgs, (unsigned int)nb_slots, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < nb_msg; i++) {
+        flow->ring[first_slot + i].length = ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) ? 0 : msgs[i].msg_len;
+    }
+    return nb_msg;
+}
+#else
+static int connect_udp_recv_batch(connect_udp_flow_t* flow, size_t first_slot, size_t nb_slots)
+{
+    int nb_msg = 0;
+
+    while ((size_t)nb_msg < nb_slots) {
+        int bytes_recv = recv(flow->fd, (char*)flow->ring[first_slot + nb_msg].buffer, CONNECT_UDP_PAYLOAD_MAX, 0);
+        if (bytes_recv < 0) {
+            break;
+        }
+        flow->ring[first_slot + nb_msg].length = bytes_recv;
+        nb_msg++;
+    }
+    return nb_msg;
+}
+#endif
+
+static size_t connect_udp_flow_poll(connect_udp_flow_t* flow, uint64_t current_time)
+{
+    size_t nb_received = 0;
+    int is_empty = 0;
+
+    while (!is_empty && flow->ring_count < CONNECT_UDP_RING_DEPTH) {
+        size_t first_slot = (flow->ring_first + flow->ring_count) % CONNECT_UDP_RING_DEPTH;
+        size_t nb_slots = CONNECT_UDP_RING_DEPTH - flow->ring_count;
+        int nb_msg;
+
+        if (first_slot + nb_slots > CONNECT_UDP_RING_DEPTH) {
+            nb_slots = CONNECT_UDP_RING_DEPTH - first_slot;
+        }
+        nb_msg = connect_udp_recv_batch(flow, first_slot, nb_slots);
+        if (nb_msg <= 0) {
+            is_empty = 1;
+        }
+        else {
+            for (int i = 0; i < nb_msg; i++) {
+                connect_udp_slot_t* slot = &flow->ring[first_slot + i];
+                if (slot->length == 0 || !connect_udp_rate_check(&flow->to_client, slot->length, current_time)) {
+                    /* Empty, truncated or over the rate limit. The slot is skipped when sending. */
+                    slot->length = 0;
+                    flow->nb_dropped++;
+                    flow->proxy->nb_dropped++;
+                }
+                else {
+                    nb_received++;
+                }
+            }
+            flow->ring_count += nb_msg;
+            is_empty = ((size_t)nb_msg < nb_slots);
+        }
+    }
+    if (nb_received > 0) {
+        (void)h3zero_set_datagram_ready(flow->cnx, flow->stream_id);
+    }
+    return nb_received;
+}
+
+size_t connect_udp_proxy_poll(connect_udp_proxy_t* proxy, uint64_t current_time)
+{
+    size_t nb_received = 0;
+
+    if (proxy != NULL) {
+        connect_udp_flow_t* flow = proxy->first;
+
+        while (flow != NULL) {
+            nb_received += connect_udp_flow_poll(flow, current_time);
+            flow = flow->next;
+        }
+    }
+    return nb_received;
+}
+
+void connect_udp_proxy_time_check(connect_udp_proxy_t* proxy, int64_t* delta_t)
+{
+    if (proxy != NULL && proxy->nb_flows > 0 && *delta_t > CONNECT_UDP_POLL_INTERVAL) {
+        *delta_t = CONNECT_UDP_POLL_INTERVAL;
+    }
+}
+
+int connect_udp_callback(picoquic_cnx_t* cnx,
+    uint8_t* bytes, size_t length,
+    picohttp_call_back_event_t event,
+    struct st_h3zero_stream_ctx_t* stream_ctx,
+    void* path_app_ctx)
+{
+    int ret = 0;
+    connect_udp_flow_t* flow = (connect_udp_flow_t*)path_app_ctx;
+
+    switch (event) {
+    case picohttp_callback_connect:
+        /* The path app context is the proxy, until the flow is created */
+        ret = connect_udp_accept(cnx, bytes, length, stream_ctx, (connect_udp_proxy_t*)path_app_ctx);
+        break;
+    case picohttp_callback_post_data:
+    case picohttp_callback_post_fin:
+        if (flow != NULL) {
+            ret = connect_udp_receive_capsules(cnx, flow, bytes, length, picoquic_get_quic_time(picoquic_get_quic_ctx(cnx)));
+            if (ret == 0 && event == picohttp_callback_post_fin) {
+                /* The client closed the request stream, which ends the flow */
+                ret = picoquic_add_to_stream(cnx, flow->stream_id, NULL, 0, 1);
+                connect_udp_flow_close(cnx, flow, stream_ctx);
+            }
+        }
+        break;
+    case picohttp_callback_post_datagram:
+        if (flow != NULL) {
+            connect_udp_receive_datagram(flow, bytes, length, picoquic_get_quic_time(picoquic_get_quic_ctx(cnx)));
+        }
+        break;
+    case picohttp_callback_provide_datagram:
+        if (flow != NULL) {
+            ret = connect_udp_provide_datagram(flow, bytes, length);
+        }
+        break;
+    case picohttp_callback_reset:
+    case picohttp_callback_free:
+        if (flow != NULL) {
+            connect_udp_flow_close(cnx, flow, stream_ctx);
+        }
+        break;
+    case picohttp_callback_deregister:
+        /* The prefix was deleted by h3zero, e.g., when the connection is closed */
+        if (flow != NULL) {
+            if (stream_ctx != NULL) {
+                stream_ctx->path_callback = NULL;
+                stream_ctx->path_callback_ctx = NULL;
+            }
+            connect_udp_flow_delete(flow);
+        }
+        break;
+    default:
+        break;
+    }
+    return ret;
+}
@@ -0,0 +1,143 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* CONNECT-UDP proxy, as defined in RFC 9298.
+ *
+ * The proxy is a path callback for the h3zero server, registered for the
+ * prefix CONNECT_UDP_PATH with the extended CONNECT method and the protocol
+ * "connect-udp". The path carries the target, per the default template
+ * "/.well-known/masque/udp/{target_host}/{target_port}/". The target host
+ * must be an IP address literal, with the colons of IPv6 addresses
+ * percent-encoded. The proxy does not resolve names.
+ *
+ * Each accepted request creates a flow with its own connected UDP socket.
+ * HTTP Datagrams with context ID 0 are sent to the target directly from
+ * the QUIC receive buffer, and so are DATAGRAM capsules that arrive in a
+ * single piece on the request stream. Datagrams with other context IDs
+ * are dropped, as required by the RFC.
+ *
+ * UDP payloads received from the target are read in batches, using
+ * recvmmsg when available, into a ring of buffers attached to the flow.
+ * The ring is drained by the prepare datagram callback, which copies each
+ * payload from the ring directly into the QUIC packet.
+ *
+ * The packet loop does not watch the flow sockets. The application calls
+ * connect_udp_proxy_poll from its loop callback, and uses
+ * connect_udp_proxy_time_check to bound the wait time while flows are open.
+ *
+ * Each flow has two token buckets, one per direction, set from the rate
+ * and burst of the proxy. Datagrams in excess are dropped.
+ */
+
+#ifndef CONNECT_UDP_H
+#define CONNECT_UDP_H
+
+#include "picosocks.h"
+#include "h3zero_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONNECT_UDP_PATH "/.well-known/masque/udp/"
+#define CONNECT_UDP_PROTOCOL "connect-udp"
+#define CONNECT_UDP_CONTEXT_ID_PAYLOAD 0
+#define CONNECT_UDP_RING_DEPTH 32
+#define CONNECT_UDP_PAYLOAD_MAX 1500
+#define CONNECT_UDP_DEFAULT_MAX_FLOWS 64
+#define CONNECT_UDP_POLL_INTERVAL 1000
+
+    typedef struct st_connect_udp_rate_t {
+        uint64_t rate; /* bytes per second, 0 if not limited */
+        uint64_t burst; /* bytes */
+        uint64_t tokens;
+        uint64_t last_time;
+    } connect_udp_rate_t;
+
+    typedef struct st_connect_udp_slot_t {
+        size_t length;
+        uint8_t buffer[CONNECT_UDP_PAYLOAD_MAX];
+    } connect_udp_slot_t;
+
+    typedef struct st_connect_udp_flow_t {
+        struct st_connect_udp_flow_t* next;
+        struct st_connect_udp_flow_t* previous;
+        struct st_connect_udp_proxy_t* proxy;
+        picoquic_cnx_t* cnx;
+        h3zero_callback_ctx_t* h3_ctx;
+        uint64_t stream_id;
+        SOCKET_TYPE fd;
+        struct sockaddr_storage target;
+        h3zero_capsule_t capsule;
+        connect_udp_rate_t to_target;
+        connect_udp_rate_t to_client;
+        size_t largest_space;
+        size_t ring_first;
+        size_t ring_count;
+        connect_udp_slot_t ring[CONNECT_UDP_RING_DEPTH];
+        uint64_t nb_sent_to_target;
+        uint64_t nb_sent_to_client;
+        uint64_t nb_dropped;
+    } connect_udp_flow_t;
+
+    typedef struct st_connect_udp_proxy_t {
+        connect_udp_flow_t* first;
+        connect_udp_flow_t* last;
+        size_t nb_flows;
+        size_t max_flows;
+        uint64_t rate;
+        uint64_t burst;
+        uint64_t nb_flows_refused;
+        uint64_t nb_sent_to_target;
+        uint64_t nb_sent_to_client;
+        uint64_t nb_dropped;
+    } connect_udp_proxy_t;
+
+    /* Create a proxy context, to be passed as path_app_ctx of the path item.
+     * A max_flows of 0 selects CONNECT_UDP_DEFAULT_MAX_FLOWS. The rate, in
+     * bytes per second, and the burst, in bytes, apply to each direction of
+     * each flow. A rate of 0 means no limit. */
+    connect_udp_proxy_t* connect_udp_proxy_create(size_t max_flows, uint64_t rate, uint64_t burst);
+    /* Delete the proxy and close the flows still open. The proxy must be
+     * deleted after the QUIC context that uses it. */
+    void connect_udp_proxy_delete(connect_udp_proxy_t* proxy);
+    /* Read the UDP payloads waiting on the flow sockets, and mark the
+     * sessions ready to send datagrams. Returns the number of payloads read. */
+    size_t connect_udp_proxy_poll(connect_udp_proxy_t* proxy, uint64_t current_time);
+    /* Bound the waiting time of the packet loop while flows are open */
+    void connect_udp_proxy_time_check(connect_udp_proxy_t* proxy, int64_t* delta_t);
+
+    /* Parse the target address from the request path */
+    int connect_udp_parse_path(const uint8_t* path, size_t path_length, struct sockaddr_storage* target);
+    /* Token bucket check, returns 1 and consumes the tokens if the length is allowed */
+    int connect_udp_rate_check(connect_udp_rate_t* rate_ctx, size_t length, uint64_t current_time);
+
+    int connect_udp_callback(picoquic_cnx_t* cnx,
+        uint8_t* bytes, size_t length,
+        picohttp_call_back_event_t event,
+        struct st_h3zero_stream_ctx_t* stream_ctx,
+        void* path_app_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONNECT_UDP_H */
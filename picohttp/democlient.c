@@ -223,7 +223,7 @@ int h09_demo_client_prepare_stream_open_command(
  */
 
 static int picoquic_demo_client_open_stream(picoquic_cnx_t* cnx,
-    picoquic_demo_callback_ctx_t* ctx,
+    picoquic_demo_callback_ctx_t* ctx, size_t scenario_index,
     uint64_t stream_id, char const* doc_name, char const* fname, char const* range, uint64_t post_size, uint64_t nb_repeat)
 {
     int ret = 0;
@@ -241,7 +241,14 @@ static int picoquic_demo_client_open_stream(picoquic_cnx_t* cnx,
         memset(stream_ctx, 0, sizeof(picoquic_demo_client_stream_ctx_t));
         stream_ctx->next_stream = ctx->first_stream;
         ctx->first_stream = stream_ctx;
-        stream_ctx->stream_id = stream_id + nb_repeat*4u;
+        stream_ctx->scenario_index = scenario_index;
+        stream_ctx->scenario_stream_id = stream_id + nb_repeat*4u;
+        /* In pipelined mode, the requests are not sent in the scenario order,
+         * and several connections may share the scenario. */
+        stream_ctx->stream_id = (ctx->pipeline == NULL) ? stream_ctx->scenario_stream_id :
+            picoquic_get_next_local_stream_id(cnx, 0);
+        stream_ctx->request_time = picoquic_get_quic_time(cnx->quic);
+        stream_ctx->first_byte_time = UINT64_MAX;
         stream_ctx->post_size = post_size;
 
         if (ctx->no_disk) {
@@ -307,7 +314,7 @@ static int picoquic_demo_client_open_stream(picoquic_cnx_t* cnx,
         }
         
         picoquic_log_app_message(cnx, "Preparing %s on stream %" PRIu64 " for %s",
-                (post_size == 0) ? "GET" : "POST", stream_id, path);
+                (post_size == 0) ? "GET" : "POST", stream_ctx->stream_id, path);
 
         /* Format the protocol specific request */
 
@@ -331,7 +338,7 @@ static int picoquic_demo_client_open_stream(picoquic_cnx_t* cnx,
             ret = picoquic_add_to_stream_with_ctx(cnx, stream_ctx->stream_id, buffer, request_length,
                 (post_size > 0 || (ctx->delay_fin && stream_id == 0))?0:1, stream_ctx);
             if (post_size > 0) {
-                ret = picoquic_mark_active_stream(cnx, stream_id, 1, stream_ctx);
+                ret = picoquic_mark_active_stream(cnx, stream_ctx->stream_id, 1, stream_ctx);
             }
         }
 
@@ -352,11 +359,156 @@ static int picoquic_demo_client_open_stream(picoquic_cnx_t* cnx,
     return ret;
 }
 
+/* Pipelined mode: per request statistics, queue of requests waiting
+ * for an open slot.
+ */
+
+static void picoquic_demo_pipeline_record(picoquic_cnx_t* cnx, picoquic_demo_pipeline_t* pipeline,
+    picoquic_demo_callback_ctx_t* ctx, picoquic_demo_client_stream_ctx_t* stream_ctx, int is_reset)
+{
+    uint64_t current_time = picoquic_get_quic_time(cnx->quic);
+    uint64_t duration = current_time - stream_ctx->request_time;
+    uint64_t first_byte = (stream_ctx->first_byte_time == UINT64_MAX) ? UINT64_MAX :
+        stream_ctx->first_byte_time - stream_ctx->request_time;
+
+    if (pipeline->nb_open > 0) {
+        pipeline->nb_open--;
+    }
+    if (is_reset) {
+        pipeline->nb_reset++;
+    }
+    else {
+        pipeline->nb_completed++;
+        quicperf_histogram_add(&pipeline->duration, duration);
+        if (first_byte != UINT64_MAX) {
+            quicperf_histogram_add(&pipeline->first_byte, first_byte);
+        }
+    }
+    pipeline->bytes_received += stream_ctx->received_length;
+    pipeline->last_completion_time = current_time;
+
+    if (pipeline->timing_file != NULL) {
+        size_t cnx_index = 0;
+        while (cnx_index < pipeline->nb_cnx && pipeline->cnx[cnx_index] != cnx) {
+            cnx_index++;
+        }
+        (void)fprintf(pipeline->timing_file, "%zu,%" PRIu64 ",%s,%" PRIu64 ",%" PRIu64 ",%" PRId64 ",%" PRIu64 ",%d\n",
+            cnx_index, stream_ctx->stream_id, ctx->demo_stream[stream_ctx->scenario_index].doc_name,
+            stream_ctx->received_length, stream_ctx->request_time - pipeline->first_request_time,
+            (first_byte == UINT64_MAX) ? (int64_t)-1 : (int64_t)first_byte, duration, is_reset);
+    }
+}
+
+static int picoquic_demo_pipeline_add_cnx(picoquic_demo_pipeline_t* pipeline, picoquic_cnx_t* cnx,
+    picoquic_demo_callback_ctx_t* ctx)
+{
+    int ret = 0;
+    size_t cnx_index = 0;
+
+    while (cnx_index < pipeline->nb_cnx && pipeline->cnx[cnx_index] != cnx) {
+        cnx_index++;
+    }
+
+    if (cnx_index >= pipeline->nb_cnx) {
+        if (pipeline->nb_cnx >= PICOQUIC_DEMO_PIPELINE_MAX_CNX) {
+            DBG_PRINTF("Cannot add more than %d connections to the pipeline", PICOQUIC_DEMO_PIPELINE_MAX_CNX);
+            ret = -1;
+        }
+        else {
+            pipeline->cnx[pipeline->nb_cnx] = cnx;
+            pipeline->cnx_ctx[pipeline->nb_cnx] = ctx;
+            pipeline->nb_cnx++;
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_demo_pipeline_enqueue(picoquic_demo_pipeline_t* pipeline, size_t scenario_index, uint64_t repeat_nb)
+{
+    int ret = 0;
+    picoquic_demo_pending_request_t* pending = (picoquic_demo_pending_request_t*)
+        malloc(sizeof(picoquic_demo_pending_request_t));
+
+    if (pending == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(pending, 0, sizeof(picoquic_demo_pending_request_t));
+        pending->scenario_index = scenario_index;
+        pending->repeat_nb = repeat_nb;
+        if (pipeline->last_pending == NULL) {
+            pipeline->first_pending = pending;
+        }
+        else {
+            pipeline->last_pending->next = pending;
+        }
+        pipeline->last_pending = pending;
+    }
+
+    return ret;
+}
+
+static int picoquic_demo_pipeline_cnx_is_live(picoquic_demo_pipeline_t* pipeline, size_t cnx_index)
+{
+    return (!pipeline->cnx_ctx[cnx_index]->connection_closed &&
+        picoquic_get_cnx_state(pipeline->cnx[cnx_index]) < picoquic_state_disconnecting);
+}
+
+/* Open pending requests until the target number of concurrent requests
+ * is reached, each time on the least loaded connection. */
+static int picoquic_demo_pipeline_pump(picoquic_demo_pipeline_t* pipeline)
+{
+    int ret = 0;
+
+    while (ret == 0 && pipeline->first_pending != NULL && pipeline->nb_open < pipeline->max_concurrent) {
+        picoquic_demo_pending_request_t* pending = pipeline->first_pending;
+        picoquic_cnx_t* cnx = NULL;
+        picoquic_demo_callback_ctx_t* ctx = NULL;
+
+        for (size_t i = 0; i < pipeline->nb_cnx; i++) {
+            if (picoquic_demo_pipeline_cnx_is_live(pipeline, i) &&
+                (ctx == NULL || pipeline->cnx_ctx[i]->nb_open_streams < ctx->nb_open_streams)) {
+                cnx = pipeline->cnx[i];
+                ctx = pipeline->cnx_ctx[i];
+            }
+        }
+
+        if (cnx == NULL) {
+            break;
+        }
+        else {
+            picoquic_demo_stream_desc_t const* desc = &ctx->demo_stream[pending->scenario_index];
+            uint64_t current_time = picoquic_get_quic_time(cnx->quic);
+
+            pipeline->first_pending = pending->next;
+            if (pipeline->first_pending == NULL) {
+                pipeline->last_pending = NULL;
+            }
+            ret = picoquic_demo_client_open_stream(cnx, ctx, pending->scenario_index, desc->stream_id,
+                desc->doc_name, desc->f_name, desc->range, (size_t)desc->post_size, pending->repeat_nb);
+            if (ret == 0) {
+                if (pipeline->nb_requests == 0) {
+                    pipeline->first_request_time = current_time;
+                }
+                pipeline->nb_requests++;
+                pipeline->nb_open++;
+            }
+            free(pending);
+        }
+    }
+
+    return ret;
+}
+
 static int picoquic_demo_client_close_stream(picoquic_cnx_t * cnx,
-    picoquic_demo_callback_ctx_t* ctx, picoquic_demo_client_stream_ctx_t* stream_ctx)
+    picoquic_demo_callback_ctx_t* ctx, picoquic_demo_client_stream_ctx_t* stream_ctx, int is_reset)
 {
     int ret = 0;
     if (stream_ctx != NULL && stream_ctx->is_open) {
+        if (ctx->pipeline != NULL) {
+            picoquic_demo_pipeline_record(cnx, ctx->pipeline, ctx, stream_ctx, is_reset);
+        }
         picoquic_unlink_app_stream_ctx(cnx, stream_ctx->stream_id);
         if (stream_ctx->f_name != NULL) {
             free(stream_ctx->f_name);
@@ -389,15 +541,40 @@ int picoquic_demo_client_start_streams(picoquic_cnx_t* cnx,
         default:
             break;
         }
+        if (ret == 0 && ctx->pipeline != NULL) {
+            ret = picoquic_demo_pipeline_add_cnx(ctx->pipeline, cnx, ctx);
+        }
+    }
+
+    if (ctx->pipeline != NULL) {
+        /* Queue the streams scheduled after the stream that just finished.
+         * The initial batch is only queued once, after all the expected
+         * connections are attached, so that it is spread across them. */
+        if (fin_stream_id != PICOQUIC_DEMO_STREAM_ID_INITIAL ||
+            (!ctx->pipeline->is_started && ctx->pipeline->nb_cnx >= ctx->pipeline->nb_cnx_expected)) {
+            for (size_t i = 0; ret == 0 && i < ctx->nb_demo_streams; i++) {
+                if (ctx->demo_stream[i].previous_stream_id == fin_stream_id) {
+                    uint64_t repeat_nb = 0;
+                    do {
+                        ret = picoquic_demo_pipeline_enqueue(ctx->pipeline, i, repeat_nb);
+                        repeat_nb++;
+                    } while (ret == 0 && repeat_nb < ctx->demo_stream[i].repeat_count);
+                }
+            }
+            ctx->pipeline->is_started = 1;
+        }
+        if (ret == 0) {
+            ret = picoquic_demo_pipeline_pump(ctx->pipeline);
+        }
     }
 
 	/* Open all the streams scheduled after the stream that
 	 * just finished */
-    for (size_t i = 0; ret == 0 && i < ctx->nb_demo_streams; i++) {
+    for (size_t i = 0; ret == 0 && ctx->pipeline == NULL && i < ctx->nb_demo_streams; i++) {
         if (ctx->demo_stream[i].previous_stream_id == fin_stream_id) {
             uint64_t repeat_nb = 0;
             do {
-                ret = picoquic_demo_client_open_stream(cnx, ctx, ctx->demo_stream[i].stream_id,
+                ret = picoquic_demo_client_open_stream(cnx, ctx, i, ctx->demo_stream[i].stream_id,
                     ctx->demo_stream[i].doc_name,
                     ctx->demo_stream[i].f_name,
                     ctx->demo_stream[i].range,
@@ -441,6 +618,25 @@ int picoquic_demo_client_open_stream_file(picoquic_cnx_t* cnx, picoquic_demo_cal
     return ret;
 }
 
+/* When a connection closes in pipelined mode, its open requests are counted
+ * as failed, and the pending requests are moved to the other connections. */
+static int picoquic_demo_client_abandon_streams(picoquic_cnx_t* cnx, picoquic_demo_callback_ctx_t* ctx)
+{
+    int ret = 0;
+
+    if (ctx->pipeline != NULL) {
+        picoquic_demo_client_stream_ctx_t* stream_ctx = ctx->first_stream;
+
+        while (stream_ctx != NULL) {
+            (void)picoquic_demo_client_close_stream(cnx, ctx, stream_ctx, 1);
+            stream_ctx = stream_ctx->next_stream;
+        }
+        ret = picoquic_demo_pipeline_pump(ctx->pipeline);
+    }
+
+    return ret;
+}
+
 int picoquic_demo_client_callback(picoquic_cnx_t* cnx,
     uint64_t stream_id, uint8_t* bytes, size_t length,
     picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
@@ -461,6 +657,9 @@ int picoquic_demo_client_callback(picoquic_cnx_t* cnx,
             stream_ctx = picoquic_demo_client_find_stream(ctx, stream_id);
         }
         if (stream_ctx != NULL && stream_ctx->is_open) {
+            if (length > 0 && stream_ctx->first_byte_time == UINT64_MAX) {
+                stream_ctx->first_byte_time = ctx->last_interaction_time;
+            }
             if (!stream_ctx->is_file_open && ctx->no_disk == 0) {
                 ret = picoquic_demo_client_open_stream_file(cnx, ctx, stream_ctx);
             }
@@ -521,8 +720,8 @@ int picoquic_demo_client_callback(picoquic_cnx_t* cnx,
             }
 
             if (fin_or_event == picoquic_callback_stream_fin) {
-                if (picoquic_demo_client_close_stream(cnx, ctx, stream_ctx)) {
-                    fin_stream_id = stream_id;
+                if (picoquic_demo_client_close_stream(cnx, ctx, stream_ctx, 0)) {
+                    fin_stream_id = stream_ctx->scenario_stream_id;
                     if (stream_id <= 64 && !ctx->no_print) {
                         fprintf(stdout, "Stream %" PRIu64 " ended after %" PRIu64 " bytes\n",
                             stream_id, stream_ctx->received_length);
@@ -541,8 +740,8 @@ int picoquic_demo_client_callback(picoquic_cnx_t* cnx,
         if (stream_ctx == NULL) {
             stream_ctx = picoquic_demo_client_find_stream(ctx, stream_id);
         }
-        if (picoquic_demo_client_close_stream(cnx, ctx, stream_ctx)) {
-            fin_stream_id = stream_id;
+        if (picoquic_demo_client_close_stream(cnx, ctx, stream_ctx, 1)) {
+            fin_stream_id = stream_ctx->scenario_stream_id;
             if (!ctx->no_print) {
                 fprintf(stdout, "Stream %" PRIu64 " reset after %" PRIu64 " bytes\n",
                     stream_id, stream_ctx->received_length);
@@ -561,12 +760,14 @@ int picoquic_demo_client_callback(picoquic_cnx_t* cnx,
             fprintf(stdout, "Received a request to close the connection.\n");
         }
         ctx->connection_closed = 1;
+        ret = picoquic_demo_client_abandon_streams(cnx, ctx);
         break;
     case picoquic_callback_application_close: /* Received application close */
         if (!ctx->no_print) {
             fprintf(stdout, "Received a request to close the application.\n");
         }
         ctx->connection_closed = 1;
+        ret = picoquic_demo_client_abandon_streams(cnx, ctx);
         break;
     case picoquic_callback_version_negotiation:
         if (!ctx->no_print) {
@@ -584,8 +785,8 @@ int picoquic_demo_client_callback(picoquic_cnx_t* cnx,
         if (stream_ctx == NULL) {
             stream_ctx = picoquic_demo_client_find_stream(ctx, stream_id);
         }
-        if (picoquic_demo_client_close_stream(cnx, ctx, stream_ctx)) {
-            fin_stream_id = stream_id;
+        if (picoquic_demo_client_close_stream(cnx, ctx, stream_ctx, 1)) {
+            fin_stream_id = stream_ctx->scenario_stream_id;
             fprintf(stdout, "Stream %d reset after %d bytes\n",
                 (int)stream_id, (int)stream_ctx->received_length);
         }
@@ -720,6 +921,83 @@ void picoquic_demo_client_delete_context(picoquic_demo_callback_ctx_t* ctx)
     }
 }
 
+picoquic_demo_pipeline_t* picoquic_demo_pipeline_create(size_t max_concurrent, size_t nb_cnx, FILE* timing_file)
+{
+    picoquic_demo_pipeline_t* pipeline = (picoquic_demo_pipeline_t*)malloc(sizeof(picoquic_demo_pipeline_t));
+
+    if (pipeline != NULL) {
+        memset(pipeline, 0, sizeof(picoquic_demo_pipeline_t));
+        pipeline->max_concurrent = (max_concurrent == 0) ? SIZE_MAX : max_concurrent;
+        pipeline->nb_cnx_expected = (nb_cnx == 0) ? 1 : nb_cnx;
+        pipeline->timing_file = timing_file;
+        if (timing_file != NULL) {
+            (void)fprintf(timing_file, "cnx,stream,path,bytes,start,first_byte,duration,reset\n");
+        }
+    }
+
+    return pipeline;
+}
+
+void picoquic_demo_pipeline_delete(picoquic_demo_pipeline_t* pipeline)
+{
+    picoquic_demo_pending_request_t* pending;
+
+    while ((pending = pipeline->first_pending) != NULL) {
+        pipeline->first_pending = pending->next;
+        free(pending);
+    }
+    free(pipeline);
+}
+
+int picoquic_demo_pipeline_is_done(picoquic_demo_pipeline_t* pipeline)
+{
+    int is_done = 0;
+
+    if (pipeline->is_started) {
+        if (pipeline->first_pending == NULL && pipeline->nb_open == 0) {
+            is_done = 1;
+        }
+        else {
+            is_done = 1;
+            for (size_t i = 0; is_done && i < pipeline->nb_cnx; i++) {
+                is_done = !picoquic_demo_pipeline_cnx_is_live(pipeline, i);
+            }
+        }
+    }
+
+    return is_done;
+}
+
+int picoquic_demo_pipeline_report(FILE* F, picoquic_demo_pipeline_t* pipeline)
+{
+    int ret = 0;
+    uint64_t duration = (pipeline->last_completion_time > pipeline->first_request_time) ?
+        pipeline->last_completion_time - pipeline->first_request_time : 0;
+    double seconds = (double)duration / 1000000.0;
+    quicperf_histogram_t const* histograms[2] = { &pipeline->duration, &pipeline->first_byte };
+    char const* names[2] = { "Request duration", "Time to first byte" };
+
+    ret |= fprintf(F, "Pipeline: %zu connections, %zu concurrent requests, %" PRIu64 " requests, %" PRIu64 " completed, %" PRIu64 " failed, %" PRIu64 " still open.\n",
+        pipeline->nb_cnx, pipeline->max_concurrent, pipeline->nb_requests, pipeline->nb_completed, pipeline->nb_reset,
+        (uint64_t)pipeline->nb_open) <= 0;
+    if (duration > 0) {
+        ret |= fprintf(F, "Received %" PRIu64 " bytes in %.3f seconds, %.1f requests/s, %.3f Mbps.\n",
+            pipeline->bytes_received, seconds, (double)pipeline->nb_completed / seconds,
+            ((double)pipeline->bytes_received * 8.0) / (double)duration) <= 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (histograms[i]->count > 0) {
+            ret |= fprintf(F, "%s (us), count %" PRIu64 ", min/average/max = %" PRIu64 "/ %" PRIu64 "/ %" PRIu64,
+                names[i], histograms[i]->count, histograms[i]->min, histograms[i]->sum / histograms[i]->count, histograms[i]->max) <= 0;
+            ret |= fprintf(F, ", p50/p90/p99 = %" PRIu64 "/ %" PRIu64 "/ %" PRIu64 "\n",
+                quicperf_histogram_percentile(histograms[i], 50), quicperf_histogram_percentile(histograms[i], 90),
+                quicperf_histogram_percentile(histograms[i], 99)) <= 0;
+        }
+    }
+
+    return ret;
+}
+
 char const * demo_client_parse_stream_spaces(char const * text) {
     while (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r') {
         text++;
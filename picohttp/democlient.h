@@ -32,6 +32,10 @@
  * the initial tests, and HTTP 3 for the full stack tests.
  */
 
+#include <stdio.h>
+#include "picosplay.h"
+#include "quicperf.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -58,6 +62,9 @@ typedef struct st_picoquic_demo_stream_ctx_t {
     uint64_t received_length;
     size_t scenario_index;
     uint64_t stream_id;
+    uint64_t scenario_stream_id; /* Differs from stream_id in pipelined mode */
+    uint64_t request_time;
+    uint64_t first_byte_time;
     uint64_t post_size;
     uint64_t post_sent;
     char* f_name;
@@ -67,6 +74,51 @@ typedef struct st_picoquic_demo_stream_ctx_t {
     unsigned int flow_opened : 1;
 } picoquic_demo_client_stream_ctx_t;
 
+/* Pipelined mode.
+ * By default, the client opens the streams of the scenario as soon as the
+ * "previous" stream completes. In pipelined mode, the requests that become
+ * eligible are queued, and the client keeps at most "max_concurrent" requests
+ * open at any given time. The pipeline can be shared by several connections
+ * to the same server. The initial requests are queued once all the expected
+ * connections are attached, and each request is then sent on the connection
+ * with the fewest open requests. Each connection
+ * allocates its own stream IDs, and the IDs listed in the scenario are only
+ * used to track the dependencies between requests.
+ * The pipeline records the duration and the time to first byte of each
+ * request. If a timing file is set, a CSV line is written for each
+ * completed request, with times in microseconds.
+ */
+#define PICOQUIC_DEMO_PIPELINE_MAX_CNX 32
+
+typedef struct st_picoquic_demo_pending_request_t {
+    struct st_picoquic_demo_pending_request_t* next;
+    size_t scenario_index;
+    uint64_t repeat_nb;
+} picoquic_demo_pending_request_t;
+
+typedef struct st_picoquic_demo_client_callback_ctx_t picoquic_demo_callback_ctx_t;
+
+typedef struct st_picoquic_demo_pipeline_t {
+    size_t max_concurrent;
+    size_t nb_open;
+    int is_started;
+    picoquic_demo_pending_request_t* first_pending;
+    picoquic_demo_pending_request_t* last_pending;
+    size_t nb_cnx;
+    size_t nb_cnx_expected;
+    picoquic_cnx_t* cnx[PICOQUIC_DEMO_PIPELINE_MAX_CNX];
+    picoquic_demo_callback_ctx_t* cnx_ctx[PICOQUIC_DEMO_PIPELINE_MAX_CNX];
+    FILE* timing_file;
+    uint64_t nb_requests;
+    uint64_t nb_completed;
+    uint64_t nb_reset;
+    uint64_t bytes_received;
+    uint64_t first_request_time;
+    uint64_t last_completion_time;
+    quicperf_histogram_t duration;
+    quicperf_histogram_t first_byte;
+} picoquic_demo_pipeline_t;
+
 typedef struct st_picoquic_demo_client_callback_ctx_t {
     picoquic_demo_client_stream_ctx_t* first_stream;
     picoquic_demo_stream_desc_t const * demo_stream;
@@ -92,6 +144,9 @@ typedef struct st_picoquic_demo_client_callback_ctx_t {
     /* Context extension for handling asynchronous creation of paths */
     void (*handle_path_allowed)(picoquic_cnx_t* cnx, void* ctx);
     void* path_allowed_context;
+
+    /* Shared pipeline, NULL if not in pipelined mode */
+    picoquic_demo_pipeline_t* pipeline;
 } picoquic_demo_callback_ctx_t;
 
 picoquic_alpn_enum picoquic_parse_alpn(char const * alpn);
@@ -123,6 +178,17 @@ int picoquic_demo_client_initialize_context(
     int no_disk, int delay_fin);
 void picoquic_demo_client_delete_context(picoquic_demo_callback_ctx_t* ctx);
 
+/* To use the pipeline, set the "pipeline" member of the client context of
+ * each connection before calling picoquic_demo_client_start_streams. The
+ * connection is attached to the pipeline when its streams are started. The
+ * scenario is run once, across all connections attached to the pipeline.
+ */
+picoquic_demo_pipeline_t* picoquic_demo_pipeline_create(size_t max_concurrent, size_t nb_cnx, FILE* timing_file);
+void picoquic_demo_pipeline_delete(picoquic_demo_pipeline_t* pipeline);
+/* All requests completed, or no connection left to carry them */
+int picoquic_demo_pipeline_is_done(picoquic_demo_pipeline_t* pipeline);
+int picoquic_demo_pipeline_report(FILE* F, picoquic_demo_pipeline_t* pipeline);
+
 int demo_client_parse_scenario_desc(char const * text, size_t * nb_streams, picoquic_demo_stream_desc_t ** desc);
 void demo_client_delete_scenario_desc(size_t nb_streams, picoquic_demo_stream_desc_t * desc);
 
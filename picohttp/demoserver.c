@@ -82,7 +82,7 @@ static picoquic_h09_server_callback_ctx_t* first_server_callback_create_context(
 static void picoquic_h09_server_callback_delete_context(picoquic_h09_server_callback_ctx_t* ctx)
 {
 
-    picosplay_empty_tree(&ctx->h3_stream_tree);
+    h3zero_delete_all_streams(ctx);
 
     free(ctx);
 }
@@ -55,6 +55,11 @@ extern char const* h3zero_server_post_response_page;
 void h3zero_init_stream_tree(picosplay_tree_t* h3_stream_tree);
 int h3zero_server_parse_path(const uint8_t* path, size_t path_length, uint64_t* echo_size,
     char** file_path, char const* web_folder, int* file_error);
+/* Find a precompressed sibling of the requested file for one of the accepted codings */
+int h3zero_server_try_encoded_path(const uint8_t* path, size_t path_length, uint8_t accept_encoding,
+    uint64_t* echo_size, char** file_path, char const* web_folder, int* file_error,
+    h3zero_content_encoding_enum* content_encoding);
+char const* h3zero_server_encoding_suffix(h3zero_content_encoding_enum content_encoding);
 int h3zero_server_prepare_to_send(void* context, size_t space, h3zero_stream_ctx_t* stream_ctx);
 
 /* Defining then the Http 0.9 variant of the server
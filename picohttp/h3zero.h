@@ -63,14 +63,16 @@ typedef enum {
     h3zero_frame_max_push_id = 0xd,
     h3zero_frame_reserved_base = 0xb,
     h3zero_frame_reserved_delta = 0x1f,
-    h3zero_frame_webtransport_stream = 0x41
+    h3zero_frame_webtransport_stream = 0x41,
+    h3zero_frame_priority_update_request = 0xF0700,
+    h3zero_frame_priority_update_push = 0xF0701
 } h3zero_frame_type_enum_t;
 
 typedef enum {
     h3zero_stream_type_control = 0,
     h3zero_stream_type_push = 1, /* Push type not supported in h3zero settings */
-    h3zero_stream_type_qpack_encoder = 2, /* not required since not using dynamic table */
-    h3zero_stream_type_qpack_decoder = 3, /* not required since not using dynamic table */
+    h3zero_stream_type_qpack_encoder = 2, /* only used if the dynamic table is enabled */
+    h3zero_stream_type_qpack_decoder = 3, /* only used if the dynamic table is enabled */
     h3zero_stream_type_webtransport = 0x54 /* unidir stream is used as specified in web transport */
 } h3zero_stream_type_enum;
 
@@ -129,6 +131,7 @@ typedef enum {
     http_header_user_agent,
     http_header_x_forwarded_for,
     http_header_x_frame_options,
+    http_header_priority,
 	http_header_max
 } http_header_enum_t;
 
@@ -138,6 +141,9 @@ typedef enum {
 #define H3ZERO_QPACK_CODE_PATH 1
 #define H3ZERO_QPACK_CODE_404 27
 #define H3ZERO_QPACK_CODE_200 25
+#define H3ZERO_QPACK_CODE_304 26
+#define H3ZERO_QPACK_ETAG 7
+#define H3ZERO_QPACK_LAST_MODIFIED 10
 #define H3ZERO_QPACK_ALLOW_GET 76
 #define H3ZERO_QPACK_AUTHORITY 0
 #define H3ZERO_QPACK_SCHEME_HTTPS 23
@@ -146,6 +152,9 @@ typedef enum {
 #define H3ZERO_QPACK_USER_AGENT 95
 #define H3ZERO_QPACK_ORIGIN 90
 #define H3ZERO_QPACK_SERVER 92
+#define H3ZERO_QPACK_CONTENT_ENCODING_BR 42
+#define H3ZERO_QPACK_CONTENT_ENCODING_GZIP 43
+#define H3ZERO_QPACK_VARY_ACCEPT_ENCODING 59
 
 typedef struct st_h3zero_qpack_static_t {
     int index;
@@ -169,6 +178,18 @@ typedef enum {
     h3zero_content_type_text_css
 } h3zero_content_type_enum;
 
+/* Content codings of precompressed responses. The accept-encoding header
+ * of a request is parsed as a bit mask of H3ZERO_ACCEPT_ENCODING(coding),
+ * without the identity coding, which is always acceptable. */
+typedef enum {
+    h3zero_content_encoding_identity = 0,
+    h3zero_content_encoding_gzip,
+    h3zero_content_encoding_br,
+    h3zero_content_encoding_zstd
+} h3zero_content_encoding_enum;
+
+#define H3ZERO_ACCEPT_ENCODING(coding) (1u << (coding))
+
 typedef enum {
     h3zero_method_none = 0,
     h3zero_method_not_supported,
@@ -181,6 +202,22 @@ typedef enum {
     h3zero_method_put
 } h3zero_method_enum;
 
+/* Header values are normally copied in separately allocated strings.
+ * When parsing with borrowed views, the values point directly into the
+ * header frame or into the static table when possible, and are not null
+ * terminated. The strings that have to be decoded or copied, such as
+ * Huffman coded values or values of dynamic table entries, are placed in
+ * an arena of blocks attached to the header parts. The frame buffer, the
+ * arena and the copied strings are all released by h3zero_release_header_parts.
+ */
+typedef struct st_h3zero_header_arena_t {
+    struct st_h3zero_header_arena_t * next;
+    size_t size;
+    size_t length;
+} h3zero_header_arena_t;
+
+#define H3ZERO_HEADER_ARENA_BLOCK_SIZE 512
+
 typedef struct st_h3zero_header_parts_t {
     h3zero_method_enum method;
     uint8_t const * path;
@@ -191,9 +228,40 @@ typedef struct st_h3zero_header_parts_t {
     h3zero_content_type_enum content_type;
     uint8_t const * protocol;
     size_t protocol_length;
+    uint8_t const * if_none_match;
+    size_t if_none_match_length;
+    uint8_t const * if_modified_since;
+    size_t if_modified_since_length;
+    uint8_t urgency;
+    uint8_t accept_encoding; /* Bit mask of H3ZERO_ACCEPT_ENCODING values */
+    uint8_t * frame; /* Frame buffer owned by the parts when values are borrowed */
+    h3zero_header_arena_t * arena;
     unsigned int path_is_huffman : 1;
+    unsigned int is_incremental : 1;
+    unsigned int has_priority : 1;
+    unsigned int is_borrowed : 1;
 } h3zero_header_parts_t;
 
+/* Extensible priorities, as defined in RFC 9218.
+ * The urgency varies from 0 (most urgent) to 7, and defaults to 3.
+ * The incremental flag indicates that the response can be processed
+ * as it arrives, and thus can be interleaved with other incremental
+ * responses of the same urgency. It defaults to false.
+ *
+ * The urgency and the incremental flag are mapped to a picoquic stream
+ * priority as (2 + 2*urgency + !incremental). Incremental responses get
+ * an even priority, served round robin, and non incremental responses
+ * an odd priority, served in FIFO order. The default u=3 maps to
+ * PICOQUIC_DEFAULT_STREAM_PRIORITY, and all levels stay below the
+ * priorities 0 and 1 used for the H3 control streams.
+ */
+#define H3ZERO_PRIORITY_URGENCY_DEFAULT 3
+#define H3ZERO_PRIORITY_URGENCY_MAX 7
+
+int h3zero_parse_priority_field(const uint8_t* value, size_t value_length, uint8_t* urgency, int* is_incremental);
+uint8_t h3zero_parse_accept_encoding(const uint8_t* value, size_t value_length);
+uint8_t h3zero_priority_to_stream_priority(uint8_t urgency, int is_incremental);
+
 /* Setting codes.
 * This list includes the "extension" settings for datagrams and web
 * transport, because we want to have common functions for coding and
@@ -252,6 +320,15 @@ uint8_t * h3zero_create_response_header_frame(uint8_t * bytes, uint8_t * bytes_m
 uint8_t* h3zero_create_error_frame(uint8_t* bytes, uint8_t* bytes_max, char const* error_code, char const* server_string);
 uint8_t* h3zero_create_response_header_frame_ex(uint8_t* bytes, uint8_t* bytes_max,
     h3zero_content_type_enum doc_type, char const* server_string);
+/* Response header for a precompressed body, with content-encoding and vary headers
+ * unless the content coding is identity. */
+uint8_t* h3zero_create_encoded_response_header_frame(uint8_t* bytes, uint8_t* bytes_max,
+    h3zero_content_type_enum doc_type, h3zero_content_encoding_enum content_encoding, char const* server_string);
+/* Response header with the validators of a cached response. If is_not_modified
+ * is set, the status is 304 and no content type is sent. */
+uint8_t* h3zero_create_validated_response_header_frame(uint8_t* bytes, uint8_t* bytes_max,
+    int is_not_modified, h3zero_content_type_enum doc_type, char const* server_string,
+    char const* etag, char const* last_modified);
 uint8_t * h3zero_create_not_found_header_frame(uint8_t * bytes, uint8_t * bytes_max);
 uint8_t* h3zero_create_not_found_header_frame_ex(uint8_t* bytes, uint8_t* bytes_max, char const* server_string);
 uint8_t * h3zero_create_bad_method_header_frame(uint8_t * bytes, uint8_t * bytes_max);
@@ -259,8 +336,11 @@ uint8_t* h3zero_create_bad_method_header_frame_ex(uint8_t* bytes, uint8_t* bytes
 
 typedef struct st_h3zero_data_stream_state_t {
     struct st_h3zero_callback_ctx_t* h3_ctx;
+    uint64_t stream_id; /* Used to acknowledge QPACK field sections */
     h3zero_header_parts_t header;
     h3zero_header_parts_t trailer;
+    uint8_t urgency; /* Value from last PRIORITY_UPDATE frame */
+    uint8_t is_incremental;
     uint64_t stream_type;
     uint8_t * current_frame;
     uint64_t current_frame_type;
@@ -277,6 +357,7 @@ typedef struct st_h3zero_data_stream_state_t {
     unsigned int trailer_found : 1;
     unsigned int is_h3_control : 1;
     unsigned int is_current_frame_ignored : 1;
+    unsigned int is_priority_updated : 1; /* PRIORITY_UPDATE received, overrides the header */
     /* Keeping track of FIN sent and FIN received, so applications can delete stream contexts that are not useful */
     unsigned int is_fin_received : 1; 
     unsigned int is_fin_sent : 1;
@@ -303,6 +384,13 @@ void h3zero_release_header_parts(h3zero_header_parts_t* header);
 
 int hzero_qpack_huffman_decode(uint8_t * bytes, uint8_t * bytes_max,
     uint8_t * decoded, size_t max_decoded, size_t * nb_decoded);
+int hzero_qpack_huffman_decode_bitwise(uint8_t * bytes, uint8_t * bytes_max,
+    uint8_t * decoded, size_t max_decoded, size_t * nb_decoded);
+size_t h3zero_qpack_huffman_length(const uint8_t * val, size_t val_length);
+uint8_t * h3zero_qpack_huffman_encode(uint8_t * bytes, uint8_t * bytes_max,
+    const uint8_t * val, size_t val_length);
+uint8_t * h3zero_qpack_string_encode(uint8_t * bytes, uint8_t * bytes_max, uint8_t prefix, uint8_t mask,
+    const uint8_t * val, size_t val_length);
 
 /* TLV_Buffer_accumulator 
 */
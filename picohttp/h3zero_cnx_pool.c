@@ -0,0 +1,510 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "picohash.h"
+#include "tls_api.h"
+#include "h3zero_cnx_pool.h"
+
+static uint64_t h3zero_pooled_cnx_hash(const void* key, const uint8_t* hash_seed)
+{
+    const h3zero_pooled_cnx_t* entry = (const h3zero_pooled_cnx_t*)key;
+    uint64_t h = picohash_siphash((const uint8_t*)entry->sni, strlen(entry->sni), hash_seed);
+
+    h = (h * 0x9E3779B97F4A7C15ull) ^ picohash_siphash((const uint8_t*)entry->alpn, strlen(entry->alpn), hash_seed);
+    h = (h * 0x9E3779B97F4A7C15ull) ^ picoquic_hash_addr((const struct sockaddr*)&entry->addr, hash_seed);
+
+    return h;
+}
+
+static int h3zero_pooled_cnx_compare(const void* key1, const void* key2)
+{
+    const h3zero_pooled_cnx_t* entry1 = (const h3zero_pooled_cnx_t*)key1;
+    const h3zero_pooled_cnx_t* entry2 = (const h3zero_pooled_cnx_t*)key2;
+
+    return (strcmp(entry1->sni, entry2->sni) == 0 &&
+        strcmp(entry1->alpn, entry2->alpn) == 0 &&
+        picoquic_compare_addr((const struct sockaddr*)&entry1->addr, (const struct sockaddr*)&entry2->addr) == 0) ? 0 : 1;
+}
+
+static picohash_item* h3zero_pooled_cnx_to_item(const void* key)
+{
+    h3zero_pooled_cnx_t* entry = (h3zero_pooled_cnx_t*)key;
+
+    return &entry->hash_item;
+}
+
+static int h3zero_cnx_pool_is_established(picoquic_cnx_t* cnx)
+{
+    picoquic_state_enum state = picoquic_get_cnx_state(cnx);
+
+    return (state == picoquic_state_client_ready_start || state == picoquic_state_ready);
+}
+
+static int h3zero_cnx_pool_is_failed(picoquic_cnx_t* cnx)
+{
+    picoquic_state_enum state = picoquic_get_cnx_state(cnx);
+
+    return (state == picoquic_state_handshake_failure || state == picoquic_state_handshake_failure_resend ||
+        state >= picoquic_state_disconnecting);
+}
+
+static int h3zero_cnx_pool_is_h3(char const* alpn)
+{
+    return (strcmp(alpn, "h3") == 0 || strncmp(alpn, "h3-", 3) == 0);
+}
+
+static int h3zero_cnx_pool_char_equal(char c1, char c2)
+{
+    if (c1 >= 'A' && c1 <= 'Z') {
+        c1 += 'a' - 'A';
+    }
+    if (c2 >= 'A' && c2 <= 'Z') {
+        c2 += 'a' - 'A';
+    }
+    return c1 == c2;
+}
+
+static int h3zero_cnx_pool_string_equal(char const* s1, char const* s2)
+{
+    while (*s1 != 0 && h3zero_cnx_pool_char_equal(*s1, *s2)) {
+        s1++;
+        s2++;
+    }
+    return *s1 == 0 && *s2 == 0;
+}
+
+int h3zero_cnx_pool_name_matches(char const* pattern, char const* name)
+{
+    int ret = 0;
+
+    if (pattern != NULL && name != NULL) {
+        if (pattern[0] == '*' && pattern[1] == '.') {
+            /* The wildcard only covers the first label */
+            char const* dot = strchr(name, '.');
+
+            ret = (dot != NULL && dot != name && h3zero_cnx_pool_string_equal(dot, pattern + 1));
+        }
+        else {
+            ret = h3zero_cnx_pool_string_equal(pattern, name);
+        }
+    }
+
+    return ret;
+}
+
+static void h3zero_cnx_pool_unlink(h3zero_cnx_pool_t* pool, h3zero_pooled_cnx_t* entry)
+{
+    if (entry->previous_entry == NULL) {
+        pool->first = entry->next_entry;
+    }
+    else {
+        entry->previous_entry->next_entry = entry->next_entry;
+    }
+    if (entry->next_entry == NULL) {
+        pool->last = entry->previous_entry;
+    }
+    else {
+        entry->next_entry->previous_entry = entry->previous_entry;
+    }
+    entry->previous_entry = NULL;
+    entry->next_entry = NULL;
+}
+
+static void h3zero_cnx_pool_push_front(h3zero_cnx_pool_t* pool, h3zero_pooled_cnx_t* entry)
+{
+    entry->previous_entry = NULL;
+    entry->next_entry = pool->first;
+    if (pool->first == NULL) {
+        pool->last = entry;
+    }
+    else {
+        pool->first->previous_entry = entry;
+    }
+    pool->first = entry;
+}
+
+static picoquic_cnx_t* h3zero_cnx_pool_create_cnx(h3zero_cnx_pool_t* pool, h3zero_pooled_cnx_t* entry,
+    const struct sockaddr* addr, uint64_t current_time)
+{
+    picoquic_cnx_t* cnx = picoquic_create_cnx(pool->quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        addr, current_time, 0, entry->sni, entry->alpn, 1);
+
+    if (cnx != NULL) {
+        if (pool->init_fn != NULL && pool->init_fn(cnx, pool->init_ctx) != 0) {
+            picoquic_delete_cnx(cnx);
+            cnx = NULL;
+        }
+        else {
+            picoquic_enable_keep_alive(cnx, 0);
+            if (picoquic_start_client_cnx(cnx) != 0) {
+                if (pool->release_fn != NULL) {
+                    pool->release_fn(cnx, pool->init_ctx);
+                }
+                picoquic_delete_cnx(cnx);
+                cnx = NULL;
+            }
+            else {
+                pool->nb_created++;
+            }
+        }
+    }
+
+    return cnx;
+}
+
+static void h3zero_cnx_pool_delete_cnx(h3zero_cnx_pool_t* pool, picoquic_cnx_t** p_cnx)
+{
+    if (*p_cnx != NULL) {
+        if (pool->release_fn != NULL) {
+            pool->release_fn(*p_cnx, pool->init_ctx);
+        }
+        picoquic_delete_cnx(*p_cnx);
+        *p_cnx = NULL;
+    }
+}
+
+static void h3zero_cnx_pool_close_cnx(picoquic_cnx_t* cnx)
+{
+    if (cnx != NULL && picoquic_get_cnx_state(cnx) < picoquic_state_disconnecting) {
+        (void)picoquic_close(cnx, 0);
+    }
+}
+
+static int h3zero_cnx_pool_is_disconnected(picoquic_cnx_t* cnx)
+{
+    return cnx == NULL || picoquic_get_cnx_state(cnx) == picoquic_state_disconnected;
+}
+
+/* Stop using the entry, and close its connections. The entry is
+ * deleted by the housekeeping once they are disconnected. */
+static void h3zero_cnx_pool_retire(h3zero_cnx_pool_t* pool, h3zero_pooled_cnx_t* entry)
+{
+    if (!entry->is_closing) {
+        entry->is_closing = 1;
+        if (entry->is_hashed) {
+            picohash_delete_key(pool->table, entry, 0);
+            entry->is_hashed = 0;
+        }
+        if (pool->nb_entries > 0) {
+            pool->nb_entries--;
+        }
+        h3zero_cnx_pool_close_cnx(entry->cnx);
+        h3zero_cnx_pool_close_cnx(entry->racing_cnx);
+        h3zero_cnx_pool_close_cnx(entry->retired_cnx);
+    }
+}
+
+static void h3zero_cnx_pool_remove(h3zero_cnx_pool_t* pool, h3zero_pooled_cnx_t* entry)
+{
+    if (!entry->is_closing) {
+        h3zero_cnx_pool_retire(pool, entry);
+    }
+    h3zero_cnx_pool_unlink(pool, entry);
+    h3zero_cnx_pool_delete_cnx(pool, &entry->cnx);
+    h3zero_cnx_pool_delete_cnx(pool, &entry->racing_cnx);
+    h3zero_cnx_pool_delete_cnx(pool, &entry->retired_cnx);
+    if (entry->sni != NULL) {
+        free(entry->sni);
+    }
+    if (entry->alpn != NULL) {
+        free(entry->alpn);
+    }
+    free(entry);
+}
+
+h3zero_cnx_pool_t* h3zero_cnx_pool_create(picoquic_quic_t* quic, size_t max_entries,
+    uint64_t idle_timeout, uint64_t race_delay)
+{
+    h3zero_cnx_pool_t* pool = (h3zero_cnx_pool_t*)malloc(sizeof(h3zero_cnx_pool_t));
+
+    if (pool != NULL) {
+        memset(pool, 0, sizeof(h3zero_cnx_pool_t));
+        pool->quic = quic;
+        pool->max_entries = (max_entries == 0) ? H3ZERO_CNX_POOL_DEFAULT_MAX_ENTRIES : max_entries;
+        pool->idle_timeout = (idle_timeout == 0) ? H3ZERO_CNX_POOL_DEFAULT_IDLE_TIMEOUT : idle_timeout;
+        pool->race_delay = (race_delay == 0) ? H3ZERO_CNX_POOL_DEFAULT_RACE_DELAY : race_delay;
+        picoquic_public_random(pool->hash_seed, sizeof(pool->hash_seed));
+        pool->table = picohash_create_ex(H3ZERO_CNX_POOL_NB_BINS, h3zero_pooled_cnx_hash,
+            h3zero_pooled_cnx_compare, h3zero_pooled_cnx_to_item, pool->hash_seed);
+        if (pool->table == NULL) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+
+    return pool;
+}
+
+/* Deleting the pool deletes the connections without waiting for them to close */
+void h3zero_cnx_pool_delete(h3zero_cnx_pool_t* pool)
+{
+    if (pool != NULL) {
+        while (pool->first != NULL) {
+            h3zero_cnx_pool_remove(pool, pool->first);
+        }
+        picohash_delete(pool->table, 0);
+        free(pool);
+    }
+}
+
+void h3zero_cnx_pool_set_callbacks(h3zero_cnx_pool_t* pool, h3zero_cnx_pool_init_fn init_fn,
+    h3zero_cnx_pool_release_fn release_fn, void* init_ctx)
+{
+    pool->init_fn = init_fn;
+    pool->release_fn = release_fn;
+    pool->init_ctx = init_ctx;
+}
+
+void h3zero_cnx_pool_set_authority_check(h3zero_cnx_pool_t* pool, h3zero_cnx_pool_authority_fn authority_fn,
+    void* authority_ctx)
+{
+    pool->authority_fn = authority_fn;
+    pool->authority_ctx = authority_ctx;
+}
+
+int h3zero_pooled_cnx_is_ready(h3zero_pooled_cnx_t* entry)
+{
+    return (entry != NULL && !entry->is_closing && entry->cnx != NULL &&
+        h3zero_cnx_pool_is_established(entry->cnx));
+}
+
+static h3zero_pooled_cnx_t* h3zero_cnx_pool_find(h3zero_cnx_pool_t* pool, char const* sni, char const* alpn,
+    const struct sockaddr* addr)
+{
+    h3zero_pooled_cnx_t key;
+    picohash_item* item;
+
+    memset(&key, 0, sizeof(key));
+    key.sni = (char*)sni;
+    key.alpn = (char*)alpn;
+    picoquic_store_addr(&key.addr, addr);
+    item = picohash_retrieve(pool->table, &key);
+
+    return (item == NULL) ? NULL : (h3zero_pooled_cnx_t*)item->key;
+}
+
+/* Find an established HTTP/3 connection to the same address, whose
+ * certificate also covers the requested authority. */
+static h3zero_pooled_cnx_t* h3zero_cnx_pool_find_coalescing(h3zero_cnx_pool_t* pool, char const* sni,
+    char const* alpn, const struct sockaddr* addr, const struct sockaddr* alt_addr)
+{
+    h3zero_pooled_cnx_t* entry = pool->first;
+
+    while (entry != NULL) {
+        if (h3zero_pooled_cnx_is_ready(entry) && strcmp(entry->alpn, alpn) == 0) {
+            struct sockaddr* peer_addr = NULL;
+
+            picoquic_get_peer_addr(entry->cnx, &peer_addr);
+            if (peer_addr != NULL &&
+                (picoquic_compare_addr(peer_addr, addr) == 0 ||
+                (alt_addr != NULL && picoquic_compare_addr(peer_addr, alt_addr) == 0)) &&
+                (h3zero_cnx_pool_string_equal(entry->sni, sni) ||
+                (pool->authority_fn != NULL && pool->authority_fn(entry->cnx, sni, pool->authority_ctx)))) {
+                break;
+            }
+        }
+        entry = entry->next_entry;
+    }
+
+    return entry;
+}
+
+static h3zero_pooled_cnx_t* h3zero_cnx_pool_add(h3zero_cnx_pool_t* pool, char const* sni, char const* alpn,
+    const struct sockaddr* addr, const struct sockaddr* alt_addr, uint64_t current_time)
+{
+    h3zero_pooled_cnx_t* entry = (h3zero_pooled_cnx_t*)malloc(sizeof(h3zero_pooled_cnx_t));
+
+    if (entry != NULL) {
+        memset(entry, 0, sizeof(h3zero_pooled_cnx_t));
+        picoquic_store_addr(&entry->addr, addr);
+        if (alt_addr != NULL) {
+            picoquic_store_addr(&entry->alt_addr, alt_addr);
+            entry->has_alt_addr = 1;
+        }
+        entry->race_time = current_time + pool->race_delay;
+        if ((entry->sni = picoquic_string_duplicate(sni)) == NULL ||
+            (entry->alpn = picoquic_string_duplicate(alpn)) == NULL ||
+            (entry->cnx = h3zero_cnx_pool_create_cnx(pool, entry, addr, current_time)) == NULL ||
+            picohash_insert(pool->table, entry) != 0) {
+            h3zero_cnx_pool_delete_cnx(pool, &entry->cnx);
+            if (entry->sni != NULL) {
+                free(entry->sni);
+            }
+            if (entry->alpn != NULL) {
+                free(entry->alpn);
+            }
+            free(entry);
+            entry = NULL;
+        }
+        else {
+            entry->is_hashed = 1;
+            h3zero_cnx_pool_push_front(pool, entry);
+            pool->nb_entries++;
+        }
+    }
+
+    return entry;
+}
+
+h3zero_pooled_cnx_t* h3zero_cnx_pool_get(h3zero_cnx_pool_t* pool, char const* sni, char const* alpn,
+    const struct sockaddr* addr, const struct sockaddr* alt_addr, uint64_t current_time)
+{
+    h3zero_pooled_cnx_t* entry = NULL;
+
+    if (pool != NULL && sni != NULL && alpn != NULL && addr != NULL) {
+        entry = h3zero_cnx_pool_find(pool, sni, alpn, addr);
+
+        if (entry != NULL) {
+            if (h3zero_cnx_pool_is_failed(entry->cnx) && entry->racing_cnx == NULL) {
+                /* Replace the failed connection */
+                h3zero_cnx_pool_retire(pool, entry);
+                entry = NULL;
+            }
+            else {
+                pool->nb_reused++;
+            }
+        }
+
+        if (entry == NULL && h3zero_cnx_pool_is_h3(alpn) &&
+            (entry = h3zero_cnx_pool_find_coalescing(pool, sni, alpn, addr, alt_addr)) != NULL) {
+            pool->nb_coalesced++;
+        }
+
+        if (entry == NULL) {
+            /* Make room for the new connection by closing the least recently used one */
+            h3zero_pooled_cnx_t* lru = pool->last;
+
+            while (pool->nb_entries >= pool->max_entries && lru != NULL) {
+                h3zero_pooled_cnx_t* previous = lru->previous_entry;
+
+                if (!lru->is_closing) {
+                    h3zero_cnx_pool_retire(pool, lru);
+                }
+                lru = previous;
+            }
+            entry = h3zero_cnx_pool_add(pool, sni, alpn, addr, alt_addr, current_time);
+        }
+
+        if (entry != NULL) {
+            entry->last_used = current_time;
+            if (entry != pool->first) {
+                h3zero_cnx_pool_unlink(pool, entry);
+                h3zero_cnx_pool_push_front(pool, entry);
+            }
+        }
+    }
+
+    return entry;
+}
+
+/* Start the alternate connection if the first one is late or failed,
+ * and keep the first that completes the handshake. */
+static uint64_t h3zero_cnx_pool_race(h3zero_cnx_pool_t* pool, h3zero_pooled_cnx_t* entry,
+    uint64_t current_time, uint64_t next_time)
+{
+    if (!entry->is_race_started && entry->has_alt_addr && !h3zero_cnx_pool_is_established(entry->cnx)) {
+        if (current_time >= entry->race_time || h3zero_cnx_pool_is_failed(entry->cnx)) {
+            entry->is_race_started = 1;
+            entry->racing_cnx = h3zero_cnx_pool_create_cnx(pool, entry,
+                (const struct sockaddr*)&entry->alt_addr, current_time);
+            pool->nb_races++;
+        }
+        else if (entry->race_time < next_time) {
+            next_time = entry->race_time;
+        }
+    }
+
+    if (entry->racing_cnx != NULL) {
+        picoquic_cnx_t* loser = NULL;
+
+        if (h3zero_cnx_pool_is_established(entry->racing_cnx) || h3zero_cnx_pool_is_failed(entry->cnx)) {
+            if (h3zero_cnx_pool_is_established(entry->racing_cnx)) {
+                pool->nb_alternate_wins++;
+            }
+            loser = entry->cnx;
+            entry->cnx = entry->racing_cnx;
+            entry->racing_cnx = NULL;
+        }
+        else if (h3zero_cnx_pool_is_established(entry->cnx) || h3zero_cnx_pool_is_failed(entry->racing_cnx)) {
+            loser = entry->racing_cnx;
+            entry->racing_cnx = NULL;
+        }
+
+        if (loser != NULL) {
+            h3zero_cnx_pool_delete_cnx(pool, &entry->retired_cnx);
+            h3zero_cnx_pool_close_cnx(loser);
+            entry->retired_cnx = loser;
+        }
+    }
+
+    return next_time;
+}
+
+uint64_t h3zero_cnx_pool_housekeeping(h3zero_cnx_pool_t* pool, uint64_t current_time)
+{
+    uint64_t next_time = UINT64_MAX;
+    h3zero_pooled_cnx_t* entry = pool->first;
+
+    while (entry != NULL) {
+        h3zero_pooled_cnx_t* next_entry = entry->next_entry;
+
+        if (!entry->is_closing) {
+            next_time = h3zero_cnx_pool_race(pool, entry, current_time, next_time);
+
+            if (entry->racing_cnx == NULL && h3zero_cnx_pool_is_failed(entry->cnx)) {
+                h3zero_cnx_pool_retire(pool, entry);
+            }
+            else if (h3zero_cnx_pool_is_established(entry->cnx)) {
+                uint64_t idle_time = entry->last_used + pool->idle_timeout;
+
+                if (current_time >= idle_time) {
+                    h3zero_cnx_pool_retire(pool, entry);
+                }
+                else if (idle_time < next_time) {
+                    next_time = idle_time;
+                }
+            }
+        }
+
+        if (entry->retired_cnx != NULL && h3zero_cnx_pool_is_disconnected(entry->retired_cnx)) {
+            h3zero_cnx_pool_delete_cnx(pool, &entry->retired_cnx);
+        }
+
+        if (entry->is_closing && h3zero_cnx_pool_is_disconnected(entry->cnx) &&
+            h3zero_cnx_pool_is_disconnected(entry->racing_cnx) && h3zero_cnx_pool_is_disconnected(entry->retired_cnx)) {
+            h3zero_cnx_pool_remove(pool, entry);
+        }
+        else if ((entry->is_closing || entry->retired_cnx != NULL) && current_time + pool->race_delay < next_time) {
+            /* Check again soon for the end of the closing connections */
+            next_time = current_time + pool->race_delay;
+        }
+
+        entry = next_entry;
+    }
+
+    return next_time;
+}
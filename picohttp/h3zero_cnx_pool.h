@@ -0,0 +1,142 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef H3ZERO_CNX_POOL_H
+#define H3ZERO_CNX_POOL_H
+
+#include <stdint.h>
+#include "picoquic.h"
+#include "picohash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pool of client connections, e.g. for a gateway relaying requests to
+ * a set of origin servers.
+ *
+ * Connections are keyed by SNI, ALPN and server address. Asking the pool
+ * for a connection returns the existing one if there is one, so that
+ * successive requests to the same origin do not pay for a new handshake.
+ * For HTTP/3, a request for another authority is coalesced on an
+ * established connection to the same address if the certificate of that
+ * connection covers the authority, as allowed by RFC 9114 section 3.3.
+ * The pool does not have access to the certificate: the check is delegated
+ * to the authority callback, which may use h3zero_cnx_pool_name_matches
+ * on the names that the certificate verifier accepted. Without callback,
+ * connections are only shared by requests for their own SNI.
+ *
+ * If an alternate address is provided, typically the IPv4 address of a
+ * server that also has an IPv6 address, the pool races the connections
+ * as in "happy eyeballs" (RFC 8305): the alternate connection starts if
+ * the first one is not established after the race delay, or as soon as
+ * it fails, and the first connection to complete the handshake is kept.
+ * Until then, the entry is not ready and requests should not be queued.
+ *
+ * Idle connections are kept alive until the idle timeout, then closed.
+ * The session tickets received on them stay in the ticket store of the
+ * QUIC context, so the next connection to the same origin resumes the
+ * session and can use 0-RTT.
+ *
+ * The pool owns the connections. The init callback is called when a
+ * connection is created, to set the application callback and context,
+ * and the release callback before it is deleted. The application must
+ * call h3zero_cnx_pool_housekeeping from its loop, at the latest at the
+ * time it returns. The pool is not thread safe.
+ */
+#define H3ZERO_CNX_POOL_DEFAULT_MAX_ENTRIES 64
+#define H3ZERO_CNX_POOL_DEFAULT_IDLE_TIMEOUT 30000000ull
+#define H3ZERO_CNX_POOL_DEFAULT_RACE_DELAY 250000ull
+#define H3ZERO_CNX_POOL_NB_BINS 32
+
+typedef int (*h3zero_cnx_pool_init_fn)(picoquic_cnx_t* cnx, void* init_ctx);
+typedef void (*h3zero_cnx_pool_release_fn)(picoquic_cnx_t* cnx, void* init_ctx);
+/* Returns 1 if the certificate presented on the connection is valid for the authority */
+typedef int (*h3zero_cnx_pool_authority_fn)(picoquic_cnx_t* cnx, char const* authority, void* authority_ctx);
+
+typedef struct st_h3zero_pooled_cnx_t {
+    picohash_item hash_item;
+    struct st_h3zero_pooled_cnx_t* previous_entry;
+    struct st_h3zero_pooled_cnx_t* next_entry;
+    char* sni;
+    char* alpn;
+    struct sockaddr_storage addr;
+    struct sockaddr_storage alt_addr;
+    int has_alt_addr;
+    int is_hashed;
+    int is_closing;
+    picoquic_cnx_t* cnx; /* First connection, or winner of the race */
+    picoquic_cnx_t* racing_cnx; /* Connection to the alternate address, during the race */
+    picoquic_cnx_t* retired_cnx; /* Loser of the race, closing */
+    int is_race_started;
+    uint64_t race_time;
+    uint64_t last_used;
+} h3zero_pooled_cnx_t;
+
+typedef struct st_h3zero_cnx_pool_t {
+    picoquic_quic_t* quic;
+    picohash_table* table;
+    h3zero_pooled_cnx_t* first; /* Most recently used */
+    h3zero_pooled_cnx_t* last;
+    size_t nb_entries;
+    size_t max_entries;
+    uint64_t idle_timeout;
+    uint64_t race_delay;
+    h3zero_cnx_pool_init_fn init_fn;
+    h3zero_cnx_pool_release_fn release_fn;
+    void* init_ctx;
+    h3zero_cnx_pool_authority_fn authority_fn;
+    void* authority_ctx;
+    uint64_t nb_created;
+    uint64_t nb_reused;
+    uint64_t nb_coalesced;
+    uint64_t nb_races;
+    uint64_t nb_alternate_wins;
+    uint8_t hash_seed[16];
+} h3zero_cnx_pool_t;
+
+/* Zero values of max_entries, idle_timeout or race_delay select the defaults */
+h3zero_cnx_pool_t* h3zero_cnx_pool_create(picoquic_quic_t* quic, size_t max_entries,
+    uint64_t idle_timeout, uint64_t race_delay);
+void h3zero_cnx_pool_delete(h3zero_cnx_pool_t* pool);
+void h3zero_cnx_pool_set_callbacks(h3zero_cnx_pool_t* pool, h3zero_cnx_pool_init_fn init_fn,
+    h3zero_cnx_pool_release_fn release_fn, void* init_ctx);
+void h3zero_cnx_pool_set_authority_check(h3zero_cnx_pool_t* pool, h3zero_cnx_pool_authority_fn authority_fn,
+    void* authority_ctx);
+/* Find or create the connection for the origin. The alternate address may
+ * be NULL. Returns NULL if a connection cannot be created. */
+h3zero_pooled_cnx_t* h3zero_cnx_pool_get(h3zero_cnx_pool_t* pool, char const* sni, char const* alpn,
+    const struct sockaddr* addr, const struct sockaddr* alt_addr, uint64_t current_time);
+/* Returns 1 if the connection of the entry is established and can carry requests */
+int h3zero_pooled_cnx_is_ready(h3zero_pooled_cnx_t* entry);
+/* Run the races, close idle connections and delete closed ones.
+ * Returns the next time at which the function should be called. */
+uint64_t h3zero_cnx_pool_housekeeping(h3zero_cnx_pool_t* pool, uint64_t current_time);
+/* Match a host name against a certificate name, which may start with
+ * a wildcard label as in "*.example.com". Comparison ignores case. */
+int h3zero_cnx_pool_name_matches(char const* pattern, char const* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* H3ZERO_CNX_POOL_H */
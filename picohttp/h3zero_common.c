@@ -71,6 +71,14 @@ static void picohttp_clear_stream_ctx(h3zero_stream_ctx_t* stream_ctx)
 	if (stream_ctx->F != NULL) {
 		stream_ctx->F = picoquic_file_close(stream_ctx->F);
 	}
+	if (stream_ctx->file_source != NULL) {
+		h3zero_file_source_release(stream_ctx->file_source);
+		stream_ctx->file_source = NULL;
+	}
+	if (stream_ctx->response_body != NULL) {
+		h3zero_response_body_release(stream_ctx->response_body);
+		stream_ctx->response_body = NULL;
+	}
 
 	if (stream_ctx->path_callback != NULL) {
 		(void)stream_ctx->path_callback(stream_ctx->cnx, NULL, 0, picohttp_callback_free, stream_ctx, stream_ctx->path_callback_ctx);
@@ -86,12 +94,45 @@ static void picohttp_clear_stream_ctx(h3zero_stream_ctx_t* stream_ctx)
 	}
 }
 
+/* The tree is the h3_stream_tree member of the callback context. The
+ * deleted context is removed from the index, and kept in the pool
+ * if the pool is not full. */
 static void picohttp_stream_node_delete(void * tree, picosplay_node_t * node)
 {
+	h3zero_callback_ctx_t* ctx = (h3zero_callback_ctx_t*)((char*)tree - offsetof(h3zero_callback_ctx_t, h3_stream_tree));
 	h3zero_stream_ctx_t * stream_ctx = picohttp_stream_node_value(node);
+
+	if (stream_ctx->is_indexed) {
+		(void)picoradix_remove(&ctx->stream_index[stream_ctx->stream_id & 3], stream_ctx->stream_id >> 2);
+	}
+	else if (ctx->nb_streams_not_indexed > 0) {
+		ctx->nb_streams_not_indexed--;
+	}
 	picohttp_clear_stream_ctx(stream_ctx);
 
-	free(stream_ctx);
+	if (ctx->nb_pooled_stream_ctx < H3ZERO_STREAM_CTX_POOL_MAX) {
+		stream_ctx->next_pooled = ctx->stream_ctx_pool;
+		ctx->stream_ctx_pool = stream_ctx;
+		ctx->nb_pooled_stream_ctx++;
+	}
+	else {
+		free(stream_ctx);
+	}
+}
+
+void h3zero_delete_all_streams(h3zero_callback_ctx_t* ctx)
+{
+	picosplay_empty_tree(&ctx->h3_stream_tree);
+	for (int i = 0; i < 4; i++) {
+		picoradix_clear(&ctx->stream_index[i]);
+	}
+	ctx->nb_streams_not_indexed = 0;
+	while (ctx->stream_ctx_pool != NULL) {
+		h3zero_stream_ctx_t* stream_ctx = ctx->stream_ctx_pool;
+		ctx->stream_ctx_pool = stream_ctx->next_pooled;
+		free(stream_ctx);
+	}
+	ctx->nb_pooled_stream_ctx = 0;
 }
 
 void h3zero_delete_stream(picoquic_cnx_t * cnx, h3zero_callback_ctx_t* ctx, h3zero_stream_ctx_t* stream_ctx)
@@ -104,13 +145,17 @@ void h3zero_delete_stream(picoquic_cnx_t * cnx, h3zero_callback_ctx_t* ctx, h3ze
 
 h3zero_stream_ctx_t* h3zero_find_stream(h3zero_callback_ctx_t* ctx, uint64_t stream_id)
 {
-	h3zero_stream_ctx_t * ret = NULL;
-	h3zero_stream_ctx_t target;
-	target.stream_id = stream_id;
-	picosplay_node_t * node = picosplay_find(&ctx->h3_stream_tree, (void*)&target);
+	h3zero_stream_ctx_t * ret = (h3zero_stream_ctx_t*)picoradix_get(&ctx->stream_index[stream_id & 3], stream_id >> 2);
 
-	if (node != NULL) {
-		ret = (h3zero_stream_ctx_t *)picohttp_stream_node_value(node);
+	if (ret == NULL && ctx->nb_streams_not_indexed > 0) {
+		h3zero_stream_ctx_t target;
+		picosplay_node_t * node;
+
+		target.stream_id = stream_id;
+		node = picosplay_find(&ctx->h3_stream_tree, (void*)&target);
+		if (node != NULL) {
+			ret = (h3zero_stream_ctx_t *)picohttp_stream_node_value(node);
+		}
 	}
 
 	return ret;
@@ -128,8 +173,16 @@ h3zero_stream_ctx_t * h3zero_find_or_create_stream(
 	/* if stream is already present, check its state. New bytes? */
 
 	if (stream_ctx == NULL && should_create) {
-		stream_ctx = (h3zero_stream_ctx_t*)
-			malloc(sizeof(h3zero_stream_ctx_t));
+		if (ctx->stream_ctx_pool != NULL) {
+			stream_ctx = ctx->stream_ctx_pool;
+			ctx->stream_ctx_pool = stream_ctx->next_pooled;
+			ctx->nb_pooled_stream_ctx--;
+			ctx->nb_stream_ctx_reused++;
+		}
+		else {
+			stream_ctx = (h3zero_stream_ctx_t*)
+				malloc(sizeof(h3zero_stream_ctx_t));
+		}
 		if (stream_ctx == NULL) {
 			/* Could not handle this stream */
 			picoquic_reset_stream(cnx, stream_id, H3ZERO_INTERNAL_ERROR);
@@ -141,6 +194,7 @@ h3zero_stream_ctx_t * h3zero_find_or_create_stream(
 			stream_ctx->cnx = cnx;
 			if (is_h3) {
 				stream_ctx->ps.stream_state.h3_ctx = ctx;
+				stream_ctx->ps.stream_state.stream_id = stream_id;
 				stream_ctx->ps.stream_state.stream_type = UINT64_MAX;
 				stream_ctx->ps.stream_state.control_stream_id = UINT64_MAX;
 				if (!IS_BIDIR_STREAM_ID(stream_id)) {
@@ -153,6 +207,12 @@ h3zero_stream_ctx_t * h3zero_find_or_create_stream(
 				}
 			}
 			picosplay_insert(&ctx->h3_stream_tree, stream_ctx);
+			if (picoradix_set(&ctx->stream_index[stream_id & 3], stream_id >> 2, stream_ctx) == 0) {
+				stream_ctx->is_indexed = 1;
+			}
+			else {
+				ctx->nb_streams_not_indexed++;
+			}
 		}
 	}
 
@@ -165,18 +225,24 @@ void h3zero_init_stream_tree(picosplay_tree_t * h3_stream_tree)
 }
 
 
-/* Declare a stream prefix, such as used by webtransport or masque
+/* Declare a stream prefix, such as used by webtransport or masque.
+ * Prefix contexts of deleted sessions are kept in a small pool, so that
+ * relays with many short lived sessions do not call malloc for each one.
  */
 
 h3zero_stream_prefix_t* h3zero_find_stream_prefix(h3zero_callback_ctx_t* ctx, uint64_t prefix)
 {
-	h3zero_stream_prefix_t* prefix_ctx = ctx->stream_prefixes.first;
+	h3zero_stream_prefix_t* prefix_ctx = (h3zero_stream_prefix_t*)picoradix_get(
+		&ctx->stream_prefixes.prefix_index[prefix & 3], prefix >> 2);
 
-	while (prefix_ctx != NULL) {
-		if (prefix_ctx->prefix == prefix) {
-			break;
+	if (prefix_ctx == NULL && ctx->stream_prefixes.nb_not_indexed > 0) {
+		prefix_ctx = ctx->stream_prefixes.first;
+		while (prefix_ctx != NULL) {
+			if (prefix_ctx->prefix == prefix) {
+				break;
+			}
+			prefix_ctx = prefix_ctx->next;
 		}
-		prefix_ctx = prefix_ctx->next;
 	}
 
 	return prefix_ctx;
@@ -188,7 +254,15 @@ int h3zero_declare_stream_prefix(h3zero_callback_ctx_t* ctx, uint64_t prefix, pi
 	h3zero_stream_prefix_t* prefix_ctx = h3zero_find_stream_prefix(ctx, prefix);
 
 	if (prefix_ctx == NULL) {
-		prefix_ctx = (h3zero_stream_prefix_t*)malloc(sizeof(h3zero_stream_prefix_t));
+		if (ctx->stream_prefixes.pool != NULL) {
+			prefix_ctx = ctx->stream_prefixes.pool;
+			ctx->stream_prefixes.pool = prefix_ctx->next;
+			ctx->stream_prefixes.nb_pooled--;
+			ctx->stream_prefixes.nb_reused++;
+		}
+		else {
+			prefix_ctx = (h3zero_stream_prefix_t*)malloc(sizeof(h3zero_stream_prefix_t));
+		}
 		if (prefix_ctx == NULL) {
 			ret = -1;
 		}
@@ -197,6 +271,7 @@ int h3zero_declare_stream_prefix(h3zero_callback_ctx_t* ctx, uint64_t prefix, pi
 			prefix_ctx->prefix = prefix;
 			prefix_ctx->function_call = function_call;
 			prefix_ctx->function_ctx = function_ctx;
+			prefix_ctx->datagram_urgency = H3ZERO_PRIORITY_URGENCY_DEFAULT;
 			if (ctx->stream_prefixes.last == NULL) {
 				ctx->stream_prefixes.first = prefix_ctx;
 			}
@@ -205,6 +280,9 @@ int h3zero_declare_stream_prefix(h3zero_callback_ctx_t* ctx, uint64_t prefix, pi
 			}
 			prefix_ctx->previous = ctx->stream_prefixes.last;
 			ctx->stream_prefixes.last = prefix_ctx;
+			if (picoradix_set(&ctx->stream_prefixes.prefix_index[prefix & 3], prefix >> 2, prefix_ctx) != 0) {
+				ctx->stream_prefixes.nb_not_indexed++;
+			}
 		}
 	}
 	else {
@@ -217,6 +295,10 @@ void h3zero_delete_stream_prefix(picoquic_cnx_t * cnx, h3zero_callback_ctx_t* ct
 {
 	h3zero_stream_prefix_t* prefix_ctx = h3zero_find_stream_prefix(ctx, prefix);
 	if (prefix_ctx != NULL) {
+		if (picoradix_remove(&ctx->stream_prefixes.prefix_index[prefix & 3], prefix >> 2) == NULL &&
+			ctx->stream_prefixes.nb_not_indexed > 0) {
+			ctx->stream_prefixes.nb_not_indexed--;
+		}
 		if (prefix_ctx->previous == NULL) {
 			ctx->stream_prefixes.first = prefix_ctx->next;
 		}
@@ -241,7 +323,25 @@ void h3zero_delete_stream_prefix(picoquic_cnx_t * cnx, h3zero_callback_ctx_t* ct
 				prefix_ctx->function_call(cnx, NULL, 0, picohttp_callback_deregister, stream_ctx, prefix_ctx->function_ctx);
 			}
 		}
-		free(prefix_ctx);
+		while (prefix_ctx->first_datagram != NULL) {
+			h3zero_queued_datagram_t* datagram = prefix_ctx->first_datagram;
+			prefix_ctx->first_datagram = datagram->next;
+			free(datagram);
+		}
+		if (ctx->nb_queued_datagrams >= prefix_ctx->nb_queued_datagrams) {
+			ctx->nb_queued_datagrams -= prefix_ctx->nb_queued_datagrams;
+		}
+		else {
+			ctx->nb_queued_datagrams = 0;
+		}
+		if (ctx->stream_prefixes.nb_pooled < H3ZERO_STREAM_PREFIX_POOL_MAX) {
+			prefix_ctx->next = ctx->stream_prefixes.pool;
+			ctx->stream_prefixes.pool = prefix_ctx;
+			ctx->stream_prefixes.nb_pooled++;
+		}
+		else {
+			free(prefix_ctx);
+		}
 	}
 	else {
 		if (cnx != NULL) {
@@ -260,6 +360,16 @@ void h3zero_delete_all_stream_prefixes(picoquic_cnx_t * cnx, h3zero_callback_ctx
 			h3zero_delete_stream_prefix(cnx, ctx, next->prefix);
 		}
 	}
+	for (int i = 0; i < 4; i++) {
+		picoradix_clear(&ctx->stream_prefixes.prefix_index[i]);
+	}
+	ctx->stream_prefixes.nb_not_indexed = 0;
+	while (ctx->stream_prefixes.pool != NULL) {
+		next = ctx->stream_prefixes.pool;
+		ctx->stream_prefixes.pool = next->next;
+		free(next);
+	}
+	ctx->stream_prefixes.nb_pooled = 0;
 }
 
 #if 0
@@ -287,6 +397,11 @@ uint64_t h3zero_parse_stream_prefix(uint8_t* buffer_8, size_t* nb_in_buffer, uin
 #endif
 
 int h3zero_protocol_init(picoquic_cnx_t* cnx)
+{
+	return h3zero_protocol_init_ex(cnx, NULL);
+}
+
+int h3zero_protocol_init_ex(picoquic_cnx_t* cnx, h3zero_callback_ctx_t* ctx)
 {
 	uint8_t decoder_stream_head = (uint8_t)h3zero_stream_type_qpack_decoder;
 	uint8_t encoder_stream_head = (uint8_t)h3zero_stream_type_qpack_encoder;
@@ -306,12 +421,21 @@ int h3zero_protocol_init(picoquic_cnx_t* cnx)
 		settings.webtransport_max_sessions = 1;
 	}
 
-	settings_buffer[0] = (uint8_t)h3zero_stream_type_control;
-	if ((settings_last = h3zero_settings_encode(settings_buffer + 1, settings_buffer + sizeof(settings_buffer), &settings)) == NULL) {
-		ret = H3ZERO_INTERNAL_ERROR;
+	if (ctx != NULL && ctx->qpack_table_capacity > 0) {
+		/* The blocked streams setting stays at zero, so the peer only
+		 * references entries that we have already acknowledged. */
+		settings.table_size = ctx->qpack_table_capacity;
+		ret = h3zero_qpack_decoder_init(&ctx->qpack_decoder, ctx->qpack_table_capacity, 0);
 	}
-	else {
-		ret = picoquic_add_to_stream(cnx, settings_stream_id, settings_buffer, settings_last - settings_buffer, 0);
+
+	settings_buffer[0] = (uint8_t)h3zero_stream_type_control;
+	if (ret == 0) {
+		if ((settings_last = h3zero_settings_encode(settings_buffer + 1, settings_buffer + sizeof(settings_buffer), &settings)) == NULL) {
+			ret = H3ZERO_INTERNAL_ERROR;
+		}
+		else {
+			ret = picoquic_add_to_stream(cnx, settings_stream_id, settings_buffer, settings_last - settings_buffer, 0);
+		}
 	}
 
 	if (ret == 0) {
@@ -321,24 +445,50 @@ int h3zero_protocol_init(picoquic_cnx_t* cnx)
 
 	if (ret == 0) {
 		uint64_t encoder_stream_id = picoquic_get_next_local_stream_id(cnx, 1);
-		/* set the encoder stream, although we do not actually create dynamic codes. */
+		/* set the encoder stream. It only carries instructions if the peer accepts a dynamic table. */
 		ret = picoquic_add_to_stream(cnx, encoder_stream_id, &encoder_stream_head, 1, 0);
 		if (ret == 0) {
 			ret = picoquic_set_stream_priority(cnx, encoder_stream_id, 1);
 		}
+		if (ctx != NULL) {
+			ctx->qpack_encoder_stream_id = encoder_stream_id;
+		}
 	}
 
 	if (ret == 0) {
 		uint64_t decoder_stream_id = picoquic_get_next_local_stream_id(cnx, 1);
-		/* set the the decoder stream, although we do not actually create dynamic codes. */
+		/* set the the decoder stream. It only carries instructions if the dynamic table is enabled. */
 		ret = picoquic_add_to_stream(cnx, decoder_stream_id, &decoder_stream_head, 1, 0);
 		if (ret == 0) {
 			ret = picoquic_set_stream_priority(cnx, decoder_stream_id, 1);
 		}
+		if (ctx != NULL) {
+			ctx->qpack_decoder_stream_id = decoder_stream_id;
+		}
 	}
 	return ret;
 }
 
+/* Send the pending QPACK instructions on the local encoder and decoder streams.
+ */
+int h3zero_qpack_send_instructions(picoquic_cnx_t* cnx, h3zero_callback_ctx_t* ctx)
+{
+	int ret = 0;
+
+	if (ctx->qpack_encoder.instructions.length > 0 && ctx->qpack_encoder_stream_id != UINT64_MAX) {
+		ret = picoquic_add_to_stream(cnx, ctx->qpack_encoder_stream_id, ctx->qpack_encoder.instructions.bytes,
+			ctx->qpack_encoder.instructions.length, 0);
+		ctx->qpack_encoder.instructions.length = 0;
+	}
+	if (ret == 0 && ctx->qpack_decoder.instructions.length > 0 && ctx->qpack_decoder_stream_id != UINT64_MAX) {
+		ret = picoquic_add_to_stream(cnx, ctx->qpack_decoder_stream_id, ctx->qpack_decoder.instructions.bytes,
+			ctx->qpack_decoder.instructions.length, 0);
+		ctx->qpack_decoder.instructions.length = 0;
+	}
+
+	return ret;
+}
+
 uint8_t* h3zero_load_frame_content(uint8_t* bytes, uint8_t* bytes_max,
 	h3zero_data_stream_state_t* stream_state, uint64_t* error_found)
 {
@@ -404,14 +554,130 @@ static void h3zero_reset_control_stream_state(h3zero_data_stream_state_t* stream
 	stream_state->current_frame_type = UINT64_MAX;
 	stream_state->current_frame_length = UINT64_MAX;
 	stream_state->current_frame_read = 0;
+	stream_state->is_current_frame_ignored = 0;
 	if (stream_state->current_frame != NULL) {
 		free(stream_state->current_frame);
 		stream_state->current_frame = NULL;
 	}
 }
 
+/* Priority update, as defined in RFC 9218.
+ * The PRIORITY_UPDATE frame is sent by the client on the control stream.
+ * Its content is the ID of the prioritized request stream, followed by
+ * the ASCII encoding of the priority field value, e.g., "u=1, i".
+ */
+uint8_t* h3zero_create_priority_update_frame(uint8_t* bytes, uint8_t* bytes_max,
+	uint64_t stream_id, uint8_t urgency, int is_incremental)
+{
+	uint8_t payload[16];
+	uint8_t* payload_last;
+
+	if (urgency > H3ZERO_PRIORITY_URGENCY_MAX) {
+		urgency = H3ZERO_PRIORITY_URGENCY_MAX;
+	}
+	/* The payload is at most 8 bytes of stream ID plus 6 bytes of field value */
+	payload_last = picoquic_frames_varint_encode(payload, payload + sizeof(payload), stream_id);
+	if (payload_last != NULL) {
+		*payload_last++ = 'u';
+		*payload_last++ = '=';
+		*payload_last++ = (uint8_t)('0' + urgency);
+		if (is_incremental) {
+			*payload_last++ = ',';
+			*payload_last++ = ' ';
+			*payload_last++ = 'i';
+		}
+	}
+
+	if (payload_last == NULL) {
+		bytes = NULL;
+	}
+	else if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, h3zero_frame_priority_update_request)) != NULL &&
+		(bytes = picoquic_frames_varint_encode(bytes, bytes_max, payload_last - payload)) != NULL) {
+		if (bytes + (payload_last - payload) > bytes_max) {
+			bytes = NULL;
+		}
+		else {
+			memcpy(bytes, payload, payload_last - payload);
+			bytes += payload_last - payload;
+		}
+	}
+	return bytes;
+}
+
+int h3zero_parse_priority_update_frame(const uint8_t* bytes, const uint8_t* bytes_max,
+	uint64_t* stream_id, uint8_t* urgency, int* is_incremental)
+{
+	int ret = 0;
+
+	*urgency = H3ZERO_PRIORITY_URGENCY_DEFAULT;
+	*is_incremental = 0;
+
+	if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, stream_id)) == NULL) {
+		ret = -1;
+	}
+	else {
+		/* A field value that cannot be parsed is ignored, leaving the defaults */
+		(void)h3zero_parse_priority_field(bytes, bytes_max - bytes, urgency, is_incremental);
+	}
+	return ret;
+}
+
+/* Apply the priority of an HTTP request to the stream that carries the response.
+ * The last PRIORITY_UPDATE received for the stream takes precedence over
+ * the priority header of the request.
+ */
+int h3zero_apply_stream_priority(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx)
+{
+	uint8_t urgency = stream_ctx->ps.stream_state.header.urgency;
+	int is_incremental = stream_ctx->ps.stream_state.header.is_incremental;
+
+	if (stream_ctx->ps.stream_state.is_priority_updated) {
+		urgency = stream_ctx->ps.stream_state.urgency;
+		is_incremental = stream_ctx->ps.stream_state.is_incremental;
+	}
+	else if (!stream_ctx->ps.stream_state.header_found) {
+		urgency = H3ZERO_PRIORITY_URGENCY_DEFAULT;
+		is_incremental = 0;
+	}
+
+	return picoquic_set_stream_priority(cnx, stream_ctx->stream_id,
+		h3zero_priority_to_stream_priority(urgency, is_incremental));
+}
+
+static void h3zero_process_priority_update(picoquic_cnx_t* cnx, h3zero_callback_ctx_t* ctx,
+	const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* error_found)
+{
+	uint64_t stream_id;
+	uint8_t urgency;
+	int is_incremental;
+
+	if (cnx != NULL && picoquic_is_client(cnx)) {
+		/* Only clients send PRIORITY_UPDATE */
+		*error_found = H3ZERO_FRAME_UNEXPECTED;
+	}
+	else if (h3zero_parse_priority_update_frame(bytes, bytes_max, &stream_id, &urgency, &is_incremental) != 0) {
+		*error_found = H3ZERO_FRAME_ERROR;
+	}
+	else if (!IS_BIDIR_STREAM_ID(stream_id) || !IS_CLIENT_STREAM_ID(stream_id)) {
+		*error_found = H3ZERO_ID_ERROR;
+	}
+	else {
+		/* Updates for streams that are not open yet are ignored. */
+		h3zero_stream_ctx_t* stream_ctx = h3zero_find_stream(ctx, stream_id);
+
+		if (stream_ctx != NULL && stream_ctx->is_h3) {
+			stream_ctx->ps.stream_state.urgency = urgency;
+			stream_ctx->ps.stream_state.is_incremental = (uint8_t)is_incremental;
+			stream_ctx->ps.stream_state.is_priority_updated = 1;
+			if (cnx != NULL) {
+				(void)h3zero_apply_stream_priority(cnx, stream_ctx);
+			}
+		}
+	}
+}
+
 static uint8_t* h3zero_parse_control_stream(uint8_t* bytes, uint8_t* bytes_max,
-	h3zero_data_stream_state_t* stream_state, h3zero_callback_ctx_t* ctx, uint64_t* error_found)
+	h3zero_data_stream_state_t* stream_state, picoquic_cnx_t* cnx, h3zero_callback_ctx_t* ctx, uint64_t* error_found)
 {
 	while (bytes != NULL && bytes < bytes_max) {
 		/* If frame type not known yet, get it. */
@@ -441,7 +707,8 @@ static uint8_t* h3zero_parse_control_stream(uint8_t* bytes, uint8_t* bytes_max,
 					bytes = NULL;
 					continue;
 				}
-				else if (stream_state->current_frame_type != h3zero_frame_settings) {
+				else if (stream_state->current_frame_type != h3zero_frame_settings &&
+					stream_state->current_frame_type != h3zero_frame_priority_update_request) {
 					stream_state->is_current_frame_ignored = 1;
 				}
 			}
@@ -477,6 +744,19 @@ static uint8_t* h3zero_parse_control_stream(uint8_t* bytes, uint8_t* bytes_max,
 					}
 					else {
 						ctx->settings.settings_received = 1;
+						if (ctx->qpack_table_capacity > 0 && ctx->settings.table_size > 0 &&
+							h3zero_qpack_encoder_init(&ctx->qpack_encoder, ctx->qpack_table_capacity,
+								ctx->settings.table_size, ctx->settings.blocked_streams) != 0) {
+							*error_found = H3ZERO_INTERNAL_ERROR;
+							bytes = NULL;
+						}
+					}
+				}
+				else if (stream_state->current_frame_type == h3zero_frame_priority_update_request) {
+					h3zero_process_priority_update(cnx, ctx, stream_state->current_frame,
+						stream_state->current_frame + stream_state->current_frame_length, error_found);
+					if (*error_found != 0) {
+						bytes = NULL;
 					}
 				}
 				h3zero_reset_control_stream_state(stream_state);
@@ -566,16 +846,26 @@ uint8_t* h3zero_parse_remote_unidir_stream(
 	}
 	switch (stream_state->stream_type) {
 	case h3zero_stream_type_control: /* used to send/receive setting frame and other control frames. */
-		bytes = h3zero_parse_control_stream(bytes, bytes_max, stream_state, ctx, error_found);
+		bytes = h3zero_parse_control_stream(bytes, bytes_max, stream_state, stream_ctx->cnx, ctx, error_found);
 		break;
 	case h3zero_stream_type_push: /* Push type not supported in current implementation */
 		bytes = bytes_max;
 		break;
-	case h3zero_stream_type_qpack_encoder: /* not required since not using dynamic table */
-		bytes = bytes_max;
+	case h3zero_stream_type_qpack_encoder: /* peer's encoder, feeds our decoder */
+		if (bytes < bytes_max && (*error_found = h3zero_qpack_decoder_receive(&ctx->qpack_decoder, bytes, bytes_max - bytes)) != 0) {
+			bytes = NULL;
+		}
+		else {
+			bytes = bytes_max;
+		}
 		break;
-	case h3zero_stream_type_qpack_decoder: /* not required since not using dynamic table */
-		bytes = bytes_max;
+	case h3zero_stream_type_qpack_decoder: /* peer's decoder, acknowledges our encoder */
+		if (bytes < bytes_max && (*error_found = h3zero_qpack_encoder_receive(&ctx->qpack_encoder, bytes, bytes_max - bytes)) != 0) {
+			bytes = NULL;
+		}
+		else {
+			bytes = bytes_max;
+		}
 		break;
 	case h3zero_stream_type_webtransport: /* unidir stream is used as specified in web transport */
 		bytes = h3zero_wt_parse_control_stream_id(bytes, bytes_max, stream_state, stream_ctx, ctx);
@@ -746,23 +1036,32 @@ uint8_t * h3zero_parse_data_stream(uint8_t * bytes, uint8_t * bytes_max,
 
 					if (stream_state->current_frame_read >= stream_state->current_frame_length) {
 						uint8_t* parsed;
+						uint64_t required_insert_count = 0;
+						int is_blocked = 0;
 						h3zero_header_parts_t* parts = (stream_state->header_found) ?
 							&stream_state->trailer : &stream_state->header;
 						stream_state->trailer_found = stream_state->header_found;
 						stream_state->header_found = 1;
-						/* parse */
-						parsed = h3zero_parse_qpack_header_frame(stream_state->current_frame,
-							stream_state->current_frame + stream_state->current_frame_length, parts);
-						if (parsed == NULL || (size_t)(parsed - stream_state->current_frame) != stream_state->current_frame_length) {
+						/* parse, with the values pointing into the frame buffer */
+						parsed = h3zero_parse_qpack_header_frame_borrowed(stream_state->current_frame,
+							stream_state->current_frame + stream_state->current_frame_length, parts,
+							(stream_state->h3_ctx == NULL) ? NULL : &stream_state->h3_ctx->qpack_decoder,
+							stream_state->stream_id, &required_insert_count, &is_blocked);
+						if (is_blocked) {
+							/* The peer should not block, since we advertise zero blocked streams */
+							*error_found = H3ZERO_QPACK_DECOMPRESSION_FAILED;
+							bytes = NULL;
+						}
+						else if (parsed == NULL || (size_t)(parsed - stream_state->current_frame) != stream_state->current_frame_length) {
 							/* protocol error */
 							*error_found = H3ZERO_FRAME_ERROR;
 							bytes = NULL;
 						}
-						/* free resource */
+						/* The frame buffer is now owned by the header parts */
+						parts->frame = stream_state->current_frame;
+						stream_state->current_frame = NULL;
 						stream_state->frame_header_parsed = 0;
 						stream_state->frame_header_read = 0;
-						free(stream_state->current_frame);
-						stream_state->current_frame = NULL;
 					}
 				}
 			}
@@ -811,8 +1110,14 @@ h3zero_callback_ctx_t* h3zero_callback_create_context(picohttp_server_parameters
 		if (param != NULL) {
 			ctx->path_table = param->path_table;
 			ctx->path_table_nb = param->path_table_nb;
+			ctx->path_router = param->path_router;
 			ctx->web_folder = param->web_folder;
+			ctx->qpack_table_capacity = param->qpack_table_capacity;
+			ctx->file_cache = param->file_cache;
+			ctx->response_cache = param->response_cache;
 		}
+		ctx->qpack_encoder_stream_id = UINT64_MAX;
+		ctx->qpack_decoder_stream_id = UINT64_MAX;
 	}
 
 	return ctx;
@@ -821,7 +1126,9 @@ h3zero_callback_ctx_t* h3zero_callback_create_context(picohttp_server_parameters
 void h3zero_callback_delete_context(picoquic_cnx_t* cnx, h3zero_callback_ctx_t* ctx)
 {
 	h3zero_delete_all_stream_prefixes(cnx, ctx);
-	picosplay_empty_tree(&ctx->h3_stream_tree);
+	h3zero_delete_all_streams(ctx);
+	h3zero_qpack_encoder_release(&ctx->qpack_encoder);
+	h3zero_qpack_decoder_release(&ctx->qpack_decoder);
 	free(ctx);
 }
 
@@ -843,6 +1150,56 @@ int h3zero_post_data_or_fin(picoquic_cnx_t* cnx, uint8_t* bytes, size_t length,
 	return ret;
 }
 
+/* Backpressure on the body of POST requests. The frame headers are
+ * consumed by the stack as soon as they are parsed, so the offset released
+ * to the transport is the number of bytes received minus the backlog.
+ */
+static int h3zero_update_post_credit(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx)
+{
+	uint64_t released = (stream_ctx->stream_received > stream_ctx->post_backlog) ?
+		stream_ctx->stream_received - stream_ctx->post_backlog : 0;
+	int ret = picoquic_stream_data_consumed(cnx, stream_ctx->stream_id, released);
+
+	if (ret == PICOQUIC_ERROR_INVALID_STREAM_ID) {
+		/* The transport stream is already closed, there is no credit to renew */
+		ret = 0;
+	}
+	return ret;
+}
+
+int h3zero_set_post_backpressure(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx)
+{
+	int ret = 0;
+
+	if (stream_ctx == NULL || !stream_ctx->is_h3 || !IS_BIDIR_STREAM_ID(stream_ctx->stream_id)) {
+		ret = -1;
+	}
+	else if (!stream_ctx->is_post_backpressure) {
+		ret = picoquic_set_app_flow_control(cnx, stream_ctx->stream_id, 1);
+		if (ret == 0) {
+			stream_ctx->is_post_backpressure = 1;
+			stream_ctx->post_backlog = 0;
+		}
+	}
+
+	return ret;
+}
+
+int h3zero_post_data_consumed(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx, size_t length)
+{
+	int ret = 0;
+
+	if (stream_ctx == NULL || !stream_ctx->is_post_backpressure || length > stream_ctx->post_backlog) {
+		ret = -1;
+	}
+	else {
+		stream_ctx->post_backlog -= length;
+		ret = h3zero_update_post_credit(cnx, stream_ctx);
+	}
+
+	return ret;
+}
+
 /* There are some streams, like unidir or server initiated bidir, that
 * require extra processing, such as tying to web transport
 * application.
@@ -918,19 +1275,209 @@ Picoquic POST Response\
 
 int h3zero_server_parse_path(const uint8_t* path, size_t path_length, uint64_t* echo_size,
 	char** file_path, char const* web_folder, int* file_error);
+int h3zero_server_try_encoded_path(const uint8_t* path, size_t path_length, uint8_t accept_encoding,
+	uint64_t* echo_size, char** file_path, char const* web_folder, int* file_error,
+	h3zero_content_encoding_enum* content_encoding);
+char const* h3zero_server_encoding_suffix(h3zero_content_encoding_enum content_encoding);
 
+/* Scan of the path table, used when no router was compiled */
 int h3zero_find_path_item(const uint8_t * path, size_t path_length, const picohttp_server_path_item_t * path_table, size_t path_table_nb)
 {
-	size_t i = 0;
+	int exact_item = -1;
+	int prefix_item = -1;
+	size_t prefix_length = 0;
 
-	while (i < path_table_nb) {
+	for (size_t i = 0; i < path_table_nb && exact_item < 0; i++) {
 		if (path_length >= path_table[i].path_length && memcmp(path, path_table[i].path, path_table[i].path_length) == 0){
-			if (path_length == path_table[i].path_length || path[path_table[i].path_length] == (uint8_t)'?')
-				return (int)i;
+			if (!path_table[i].is_prefix) {
+				if (path_length == path_table[i].path_length || path[path_table[i].path_length] == (uint8_t)'?') {
+					exact_item = (int)i;
+				}
+			}
+			else if (prefix_item < 0 || path_table[i].path_length > prefix_length) {
+				prefix_item = (int)i;
+				prefix_length = path_table[i].path_length;
+			}
+		}
+	}
+
+	return (exact_item >= 0) ? exact_item : prefix_item;
+}
+
+/* The router is first built as a trie in which the children of a node
+ * are chained in order of byte value, then compiled in breadth first
+ * order so that the children of a node are contiguous. */
+typedef struct st_h3zero_path_build_node_t {
+	int first_child;
+	int next_sibling;
+	int exact_item;
+	int prefix_item;
+	uint8_t byte;
+} h3zero_path_build_node_t;
+
+static int h3zero_path_router_add(h3zero_path_build_node_t* build, size_t* nb_build,
+	const picohttp_server_path_item_t* item, int item_index)
+{
+	int node = 0;
+
+	for (size_t i = 0; i < item->path_length; i++) {
+		uint8_t b = (uint8_t)item->path[i];
+		int* link = &build[node].first_child;
+
+		while (*link >= 0 && build[*link].byte < b) {
+			link = &build[*link].next_sibling;
+		}
+		if (*link < 0 || build[*link].byte != b) {
+			int child = (int)(*nb_build)++;
+
+			build[child].first_child = -1;
+			build[child].next_sibling = *link;
+			build[child].exact_item = -1;
+			build[child].prefix_item = -1;
+			build[child].byte = b;
+			*link = child;
+		}
+		node = *link;
+	}
+
+	/* If several items have the same path, the first one is kept */
+	if (item->is_prefix) {
+		if (build[node].prefix_item < 0) {
+			build[node].prefix_item = item_index;
+		}
+	}
+	else if (build[node].exact_item < 0) {
+		build[node].exact_item = item_index;
+	}
+
+	return node;
+}
+
+h3zero_path_router_t* h3zero_path_router_create(const picohttp_server_path_item_t* path_table, size_t path_table_nb)
+{
+	h3zero_path_router_t* router = NULL;
+	h3zero_path_build_node_t* build = NULL;
+	int* order = NULL;
+	size_t nb_build_max = 1;
+	size_t nb_build = 1;
+
+	for (size_t i = 0; i < path_table_nb; i++) {
+		nb_build_max += path_table[i].path_length;
+	}
+
+	if ((build = (h3zero_path_build_node_t*)malloc(nb_build_max * sizeof(h3zero_path_build_node_t))) != NULL &&
+		(order = (int*)malloc(nb_build_max * sizeof(int))) != NULL &&
+		(router = (h3zero_path_router_t*)malloc(sizeof(h3zero_path_router_t))) != NULL) {
+		memset(router, 0, sizeof(h3zero_path_router_t));
+		memset(&build[0], 0, sizeof(h3zero_path_build_node_t));
+		build[0].first_child = -1;
+		build[0].next_sibling = -1;
+		build[0].exact_item = -1;
+		build[0].prefix_item = -1;
+
+		for (size_t i = 0; i < path_table_nb; i++) {
+			(void)h3zero_path_router_add(build, &nb_build, &path_table[i], (int)i);
+		}
+
+		if ((router->nodes = (h3zero_path_node_t*)malloc(nb_build * sizeof(h3zero_path_node_t))) == NULL) {
+			free(router);
+			router = NULL;
+		}
+		else {
+			/* Breadth first: node n of the router is built from node order[n] */
+			size_t nb_ordered = 1;
+
+			order[0] = 0;
+			for (size_t n = 0; n < nb_build; n++) {
+				h3zero_path_build_node_t* b_node = &build[order[n]];
+				h3zero_path_node_t* r_node = &router->nodes[n];
+
+				r_node->first_child = (uint32_t)nb_ordered;
+				r_node->nb_children = 0;
+				r_node->byte = b_node->byte;
+				r_node->exact_item = b_node->exact_item;
+				r_node->prefix_item = b_node->prefix_item;
+				for (int child = b_node->first_child; child >= 0; child = build[child].next_sibling) {
+					order[nb_ordered++] = child;
+					r_node->nb_children++;
+				}
+			}
+			router->nb_nodes = nb_build;
 		}
-		i++;
 	}
-	return -1;
+
+	if (build != NULL) {
+		free(build);
+	}
+	if (order != NULL) {
+		free(order);
+	}
+
+	return router;
+}
+
+void h3zero_path_router_delete(h3zero_path_router_t* router)
+{
+	if (router != NULL) {
+		if (router->nodes != NULL) {
+			free(router->nodes);
+		}
+		free(router);
+	}
+}
+
+int h3zero_path_router_find(const h3zero_path_router_t* router, const uint8_t* path, size_t path_length)
+{
+	int exact_item = -1;
+	int prefix_item = -1;
+	const h3zero_path_node_t* node = &router->nodes[0];
+	size_t i = 0;
+
+	while (node != NULL) {
+		if (node->prefix_item >= 0) {
+			/* Nodes are visited in order of increasing length */
+			prefix_item = node->prefix_item;
+		}
+		if (node->exact_item >= 0 && (i == path_length || path[i] == (uint8_t)'?') &&
+			(exact_item < 0 || node->exact_item < exact_item)) {
+			exact_item = node->exact_item;
+		}
+		if (i >= path_length) {
+			node = NULL;
+		}
+		else {
+			/* Binary search of the next byte in the children */
+			const h3zero_path_node_t* children = &router->nodes[node->first_child];
+			size_t low = 0;
+			size_t high = node->nb_children;
+
+			node = NULL;
+			while (low < high) {
+				size_t middle = (low + high) / 2;
+
+				if (children[middle].byte == path[i]) {
+					node = &children[middle];
+					break;
+				}
+				else if (children[middle].byte < path[i]) {
+					low = middle + 1;
+				}
+				else {
+					high = middle;
+				}
+			}
+			i++;
+		}
+	}
+
+	return (exact_item >= 0) ? exact_item : prefix_item;
+}
+
+/* Find the path item for a request, using the router if there is one */
+static int h3zero_find_path_item_ctx(h3zero_callback_ctx_t* ctx, const uint8_t* path, size_t path_length)
+{
+	return (ctx->path_router != NULL) ? h3zero_path_router_find(ctx->path_router, path, path_length) :
+		h3zero_find_path_item(path, path_length, ctx->path_table, ctx->path_table_nb);
 }
 
 /* TODO find a better place. */
@@ -982,6 +1529,18 @@ h3zero_content_type_enum h3zero_get_content_type_by_path(const char *path) {
 	return h3zero_content_type_text_plain;
 }
 
+/* Serve a file from the shared mapping, unless the file changed size since it was found */
+static void h3zero_open_file_source(h3zero_callback_ctx_t* app_ctx, h3zero_stream_ctx_t* stream_ctx)
+{
+	if (stream_ctx->file_path != NULL && app_ctx->file_cache != NULL) {
+		stream_ctx->file_source = h3zero_file_cache_open(app_ctx->file_cache, stream_ctx->file_path);
+		if (stream_ctx->file_source != NULL && stream_ctx->file_source->length != stream_ctx->echo_length) {
+			h3zero_file_source_release(stream_ctx->file_source);
+			stream_ctx->file_source = NULL;
+		}
+	}
+}
+
 /* Processing of the request frame.
 * This function is called after the client's stream is closed,
 * after verifying that a request was received */
@@ -1003,9 +1562,42 @@ int h3zero_process_request_frame(
 	*o_bytes++ = h3zero_frame_header;
 	o_bytes += 2; /* reserve two bytes for frame length */
 
+	/* Schedule the response according to the request priority */
+	(void)h3zero_apply_stream_priority(cnx, stream_ctx);
+
 	if (stream_ctx->ps.stream_state.header.method == h3zero_method_get) {
 		/* Manage GET */
-		if (h3zero_server_parse_path(stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length,
+		uint64_t current_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+		h3zero_cached_response_t* cached = NULL;
+		h3zero_content_encoding_enum content_encoding = h3zero_content_encoding_identity;
+
+		/* Precompressed variants are served from their file, the response cache only holds
+		 * the identity responses. */
+		if (h3zero_server_try_encoded_path(stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length,
+			stream_ctx->ps.stream_state.header.accept_encoding, &stream_ctx->echo_length, &stream_ctx->file_path,
+			app_ctx->web_folder, &file_error, &content_encoding) != 0) {
+			cached = h3zero_response_cache_get(app_ctx->response_cache,
+				stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length, current_time);
+		}
+
+		if (cached != NULL) {
+			/* Already found and loaded */
+		}
+		else if (content_encoding != h3zero_content_encoding_identity) {
+			/* The content type is that of the original file */
+			size_t type_length = strlen(stream_ctx->file_path) - strlen(h3zero_server_encoding_suffix(content_encoding));
+			char saved = stream_ctx->file_path[type_length];
+			h3zero_content_type_enum content_type;
+
+			stream_ctx->file_path[type_length] = 0;
+			content_type = h3zero_get_content_type_by_path(stream_ctx->file_path);
+			stream_ctx->file_path[type_length] = saved;
+			h3zero_open_file_source(app_ctx, stream_ctx);
+			response_length = stream_ctx->echo_length;
+			o_bytes = h3zero_create_encoded_response_header_frame(o_bytes, o_bytes_max, content_type,
+				content_encoding, H3ZERO_USER_AGENT_STRING);
+		}
+		else if (h3zero_server_parse_path(stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length,
 			&stream_ctx->echo_length, &stream_ctx->file_path, app_ctx->web_folder, &file_error) != 0) {
 			char log_text[256];
 			picoquic_log_app_message(cnx, "Cannot find file for path: <%s> in folder <%s>, error: 0x%x",
@@ -1015,7 +1607,14 @@ int h3zero_process_request_frame(
 			o_bytes = h3zero_create_not_found_header_frame(o_bytes, o_bytes_max);
 			/* TODO: consider known-url?data construct */
 		}
+		else if (stream_ctx->file_path != NULL && app_ctx->response_cache != NULL &&
+			(cached = h3zero_response_cache_add(app_ctx->response_cache, stream_ctx->ps.stream_state.header.path,
+				stream_ctx->ps.stream_state.header.path_length, stream_ctx->file_path,
+				h3zero_get_content_type_by_path(stream_ctx->file_path), current_time)) != NULL) {
+			/* Loaded in the cache, will be served from there */
+		}
 		else {
+			h3zero_open_file_source(app_ctx, stream_ctx);
 			response_length = (stream_ctx->echo_length == 0) ?
 				strlen(h3zero_server_default_page) : stream_ctx->echo_length;
 			o_bytes = h3zero_create_response_header_frame(o_bytes, o_bytes_max,
@@ -1025,11 +1624,35 @@ int h3zero_process_request_frame(
 			 * Currently picoquic doesn't support query strings.
 			 */
 		}
+
+		if (cached != NULL) {
+			/* Copy the precomputed header section, and share the body */
+			uint8_t const* section = cached->header_section;
+			size_t section_length = cached->header_length;
+
+			if (h3zero_response_cache_is_not_modified(app_ctx->response_cache, cached, &stream_ctx->ps.stream_state.header)) {
+				section = cached->not_modified_section;
+				section_length = cached->not_modified_length;
+				stream_ctx->echo_length = 0;
+			}
+			else {
+				stream_ctx->response_body = h3zero_response_body_reference(cached->body);
+				stream_ctx->echo_length = cached->body->length;
+				response_length = stream_ctx->echo_length;
+			}
+			if (o_bytes + section_length > o_bytes_max) {
+				o_bytes = NULL;
+			}
+			else {
+				memcpy(o_bytes, section, section_length);
+				o_bytes += section_length;
+			}
+		}
 	}
 	else if (stream_ctx->ps.stream_state.header.method == h3zero_method_post) {
 		/* Manage Post. */
 		if (stream_ctx->path_callback == NULL && stream_ctx->post_received == 0) {
-			int path_item = h3zero_find_path_item(stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length, app_ctx->path_table, app_ctx->path_table_nb);
+			int path_item = h3zero_find_path_item_ctx(app_ctx, stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length);
 			if (path_item >= 0) {
 				/* TODO-POST: move this code to post-fin callback.*/
 				stream_ctx->path_callback = app_ctx->path_table[path_item].path_callback;
@@ -1058,7 +1681,7 @@ int h3zero_process_request_frame(
 		/* The connect handling depends on the requested protocol */
 
 		if (stream_ctx->path_callback == NULL) {
-			int path_item = h3zero_find_path_item(stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length, app_ctx->path_table, app_ctx->path_table_nb);
+			int path_item = h3zero_find_path_item_ctx(app_ctx, stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length);
 			if (path_item >= 0) {
 				stream_ctx->path_callback = app_ctx->path_table[path_item].path_callback;
 				if (stream_ctx->path_callback(cnx, (uint8_t*)stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length, picohttp_callback_connect,
@@ -1100,8 +1723,21 @@ int h3zero_process_request_frame(
 		ret = picoquic_reset_stream(cnx, stream_ctx->stream_id, H3ZERO_INTERNAL_ERROR);
 	}
 	else {
-		size_t header_length = o_bytes - &buffer[3];
-		int is_fin_stream = (stream_ctx->echo_length == 0) ? (1 - stream_ctx->is_upgraded) : 0;
+		size_t header_length;
+		int is_fin_stream;
+
+		if (app_ctx->qpack_encoder.table.capacity > 0) {
+			/* Rewrite the section with references to the dynamic table */
+			uint8_t encoded[sizeof(buffer)];
+			uint8_t* encoded_last = h3zero_qpack_encode_section(&app_ctx->qpack_encoder, stream_ctx->stream_id,
+				&buffer[3], o_bytes, encoded, encoded + sizeof(encoded) - 3);
+			if (encoded_last != NULL) {
+				memcpy(&buffer[3], encoded, encoded_last - encoded);
+				o_bytes = &buffer[3] + (encoded_last - encoded);
+			}
+		}
+		header_length = o_bytes - &buffer[3];
+		is_fin_stream = (stream_ctx->echo_length == 0) ? (1 - stream_ctx->is_upgraded) : 0;
 		buffer[1] = (uint8_t)((header_length >> 8) | 0x40);
 		buffer[2] = (uint8_t)(header_length & 0xFF);
 
@@ -1214,6 +1850,7 @@ int h3zero_process_h3_server_data(picoquic_cnx_t* cnx,
 	uint64_t error_found = 0;
 	uint8_t* bytes_max = bytes + length;
 
+	stream_ctx->stream_received += length;
 	while (bytes < bytes_max) {
 		bytes = h3zero_parse_data_stream(bytes, bytes_max, &stream_ctx->ps.stream_state, &available_data, &error_found);
 		if (bytes == NULL) {
@@ -1235,8 +1872,8 @@ int h3zero_process_h3_server_data(picoquic_cnx_t* cnx,
 					}
 				}
 			}
-			else if (stream_ctx->ps.stream_state.header_found && stream_ctx->post_received == 0) {
-				int path_item = h3zero_find_path_item(stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length, ctx->path_table, ctx->path_table_nb);
+			else if (stream_ctx->ps.stream_state.header_found && stream_ctx->post_received == 0 && !stream_ctx->is_upgraded) {
+				int path_item = h3zero_find_path_item_ctx(ctx, stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length);
 				if (path_item >= 0) {
 					stream_ctx->path_callback = ctx->path_table[path_item].path_callback;
 					stream_ctx->path_callback(cnx, (uint8_t*)stream_ctx->ps.stream_state.header.path, stream_ctx->ps.stream_state.header.path_length, picohttp_callback_post,
@@ -1260,11 +1897,18 @@ int h3zero_process_h3_server_data(picoquic_cnx_t* cnx,
 				*/
 				int is_post = stream_ctx->ps.stream_state.header.method == h3zero_method_post;
 
+				if (stream_ctx->is_post_backpressure) {
+					/* The callback may consume the data immediately */
+					stream_ctx->post_backlog += available_data;
+				}
 				ret = stream_ctx->path_callback(cnx, bytes, available_data,
 					(fin_or_event == picoquic_callback_stream_fin && !is_post) ?
 					picohttp_callback_post_fin : picohttp_callback_post_data, stream_ctx, stream_ctx->path_callback_ctx);
 				if (is_post) {
 					stream_ctx->post_received += available_data;
+					if (ret == 0 && stream_ctx->is_post_backpressure) {
+						ret = h3zero_update_post_credit(cnx, stream_ctx);
+					}
 				}
 				else {
 					process_complete = 1;
@@ -1283,6 +1927,13 @@ int h3zero_process_h3_server_data(picoquic_cnx_t* cnx,
 				ret = stream_ctx->path_callback(cnx, NULL, 0, picohttp_callback_post_fin, stream_ctx, stream_ctx->path_callback_ctx);
 			}
 		}
+		else if (stream_ctx->is_upgraded) {
+			/* The CONNECT request was already accepted. Later segments without data
+			 * must not be processed as a new request. */
+			if (fin_or_event == picoquic_callback_stream_fin && available_data == 0 && stream_ctx->path_callback != NULL) {
+				ret = stream_ctx->path_callback(cnx, NULL, 0, picohttp_callback_post_fin, stream_ctx, stream_ctx->path_callback_ctx);
+			}
+		}
 		else {
 			if (fin_or_event == picoquic_callback_stream_fin || stream_ctx->ps.stream_state.header.method == h3zero_method_connect) {
 				/* Process the request header. */
@@ -1468,6 +2119,10 @@ int h3zero_callback_data(picoquic_cnx_t* cnx,
 				fin_or_event, stream_ctx, ctx);
 		}
 	}
+	if (ret == 0) {
+		/* Parsing headers or encoder instructions may have produced QPACK instructions */
+		ret = h3zero_qpack_send_instructions(cnx, ctx);
+	}
 	return ret;
 }
 
@@ -1517,19 +2172,57 @@ int h3zero_prepare_to_send_buffer(void* context, size_t space,
 	return ret;
 }
 
+/* Same as h3zero_prepare_to_send_buffer, copying the data directly from
+ * memory: a file mapped in memory, or the body of a cached response. */
+static int h3zero_prepare_to_send_mapped(void* context, size_t space,
+	uint64_t echo_length, uint64_t* echo_sent, const uint8_t* data)
+{
+	int ret = 0;
+
+	if (*echo_sent < echo_length) {
+		uint8_t * buffer;
+		uint64_t available = echo_length - *echo_sent;
+		int is_fin = 1;
+
+		if (available > space) {
+			available = space;
+			is_fin = 0;
+		}
+
+		buffer = picoquic_provide_stream_data_buffer(context, (size_t)available, is_fin, !is_fin);
+		if (buffer != NULL) {
+			memcpy(buffer, data + *echo_sent, (size_t)available);
+			*echo_sent += available;
+		}
+		else {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
 int h3zero_prepare_to_send(int client_mode, void* context, size_t space,
 	h3zero_stream_ctx_t* stream_ctx)
 {
 	int ret = 0;
 
-	if (!client_mode && stream_ctx->F == NULL && stream_ctx->file_path != NULL) {
+	if (!client_mode && stream_ctx->response_body != NULL) {
+		ret = h3zero_prepare_to_send_mapped(context, space, stream_ctx->echo_length, &stream_ctx->echo_sent,
+			stream_ctx->response_body->data);
+	}
+	else if (!client_mode && stream_ctx->file_source != NULL) {
+		ret = h3zero_prepare_to_send_mapped(context, space, stream_ctx->echo_length, &stream_ctx->echo_sent,
+			stream_ctx->file_source->data);
+	}
+	else if (!client_mode && stream_ctx->F == NULL && stream_ctx->file_path != NULL) {
 		stream_ctx->F = picoquic_file_open(stream_ctx->file_path, "rb");
 		if (stream_ctx->F == NULL) {
 			ret = -1;
 		}
 	}
 
-	if (ret == 0) {
+	if (ret == 0 && stream_ctx->file_source == NULL && stream_ctx->response_body == NULL) {
 		if (client_mode) {
 			ret = h3zero_prepare_to_send_buffer(context, space, stream_ctx->post_size, &stream_ctx->post_sent, NULL);
 		}
@@ -1593,6 +2286,13 @@ int h3zero_callback_prepare_to_send(picoquic_cnx_t* cnx,
 *  Sending of callback is by polling the prefixes that are marked active for
 *  datagrams, in round robin fashion. If the datagram can be sent, the code
 *  automatically include the quarter stream ID corresponding to the context.
+*
+*  Applications can also queue datagrams for a prefix. The queued datagrams
+*  are sent first, by order of urgency of their prefix, and round robin
+*  between prefixes of the same urgency. As many as fit are sent in the
+*  same callback, each in its own DATAGRAM frame, so that small datagrams
+*  from several sessions share a packet. The polled prefixes get the space
+*  left after that.
 */
 
 int h3zero_callback_datagram(picoquic_cnx_t* cnx, uint8_t* bytes, size_t length, h3zero_callback_ctx_t* h3_ctx)
@@ -1633,7 +2333,7 @@ void h3zero_receive_datagram_capsule(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* s
 			/* Should signal the error HTTP_DATAGRAM_ERROR */
 		}
 		else {
-			prefix_ctx->function_call(cnx, capsule->capsule_buffer, capsule->capsule_length, picohttp_callback_post_datagram, stream_ctx, prefix_ctx->function_ctx);
+			prefix_ctx->function_call(cnx, (uint8_t*)capsule->capsule_value, capsule->capsule_length, picohttp_callback_post_datagram, stream_ctx, prefix_ctx->function_ctx);
 		}
 	}
 }
@@ -1701,6 +2401,76 @@ static int h3zero_callback_prepare_datagram_in_context(picoquic_cnx_t* cnx, void
 	return data_sent;
 }
 
+/* Send the first datagram queued for the prefix if it fits in the space left.
+ * Frames after the first one cost one more byte for the frame type. If the
+ * frame does not fit with its length field, the stack sends it without length
+ * at the end of the packet, and there is no space left. */
+static int h3zero_send_queued_datagram(void* context, size_t* space_left, int is_first_frame,
+	h3zero_callback_ctx_t* h3_ctx, h3zero_stream_prefix_t* prefix_ctx)
+{
+	int is_sent = 0;
+	h3zero_queued_datagram_t* datagram = prefix_ctx->first_datagram;
+	uint64_t quarter_stream_id = prefix_ctx->prefix >> 2;
+	size_t total_length = picoquic_frames_varint_encode_length(quarter_stream_id) + datagram->length;
+	size_t frame_overhead = (is_first_frame) ? 0 : 1;
+
+	if (total_length + frame_overhead <= *space_left) {
+		uint8_t* buffer = picoquic_provide_datagram_buffer_ex(context, total_length, picoquic_datagram_not_active);
+		if (buffer != NULL) {
+			size_t frame_length = frame_overhead + picoquic_frames_varint_encode_length(total_length) + total_length;
+			uint8_t* bytes = picoquic_frames_varint_encode(buffer, buffer + total_length, quarter_stream_id);
+
+			memcpy(bytes, datagram->data, datagram->length);
+			*space_left = (frame_length < *space_left) ? *space_left - frame_length : 0;
+			prefix_ctx->first_datagram = datagram->next;
+			if (prefix_ctx->first_datagram == NULL) {
+				prefix_ctx->last_datagram = NULL;
+			}
+			prefix_ctx->nb_queued_datagrams--;
+			prefix_ctx->nb_queued_datagrams_sent++;
+			h3_ctx->nb_queued_datagrams--;
+			free(datagram);
+			is_sent = 1;
+		}
+	}
+	return is_sent;
+}
+
+/* Send the queued datagrams, by order of urgency. Within an urgency level, each round
+ * sends one datagram per prefix, starting after the last prefix served. Datagrams that
+ * do not fit stay queued for the next packet. Returns the number of frames sent. */
+static int h3zero_prepare_queued_datagrams(void* context, size_t* space_left, h3zero_callback_ctx_t* h3_ctx)
+{
+	int nb_frames = 0;
+	h3zero_stream_prefix_t* start_ctx = h3zero_find_stream_prefix(h3_ctx, h3_ctx->last_queued_datagram_prefix);
+
+	start_ctx = (start_ctx == NULL || start_ctx->next == NULL) ? h3_ctx->stream_prefixes.first : start_ctx->next;
+
+	for (uint8_t urgency = 0; urgency <= H3ZERO_PRIORITY_URGENCY_MAX &&
+		h3_ctx->nb_queued_datagrams > 0 && *space_left > 0; urgency++) {
+		int is_progressing = 1;
+
+		while (is_progressing && *space_left > 0) {
+			h3zero_stream_prefix_t* prefix_ctx = start_ctx;
+
+			is_progressing = 0;
+			do {
+				if (prefix_ctx->datagram_urgency == urgency && prefix_ctx->first_datagram != NULL &&
+					h3zero_send_queued_datagram(context, space_left, nb_frames == 0, h3_ctx, prefix_ctx)) {
+					nb_frames++;
+					is_progressing = 1;
+					h3_ctx->last_queued_datagram_prefix = prefix_ctx->prefix;
+				}
+				prefix_ctx = (prefix_ctx->next == NULL) ? h3_ctx->stream_prefixes.first : prefix_ctx->next;
+			} while (prefix_ctx != start_ctx && *space_left > 0);
+		}
+	}
+	if (nb_frames > 1) {
+		h3_ctx->nb_datagram_frames_coalesced += nb_frames - 1;
+	}
+	return nb_frames;
+}
+
 int h3zero_callback_prepare_datagram(picoquic_cnx_t* cnx, void* context, size_t space, h3zero_callback_ctx_t* h3_ctx)
 {
 	/* First pass will start just after the last datagram prefix polled, then next pass until that prefix  */
@@ -1709,6 +2479,15 @@ int h3zero_callback_prepare_datagram(picoquic_cnx_t* cnx, void* context, size_t
 	int data_sent = 0;
 	int still_active = 0;
 	int all_checked = 0;
+
+	if (h3_ctx->nb_queued_datagrams > 0 && h3_ctx->stream_prefixes.first != NULL) {
+		size_t space_left = space;
+
+		if (h3zero_prepare_queued_datagrams(context, &space_left, h3_ctx) > 0) {
+			/* The polled prefixes can use what is left, after the type of a new frame */
+			space = (space_left > 1) ? space_left - 1 : 0;
+		}
+	}
 	/* checked the prefixes after the last sent one. */
 	while (prefix_ctx != NULL) {
 		data_sent = h3zero_callback_prepare_datagram_in_context(cnx, context, space, h3_ctx, prefix_ctx);
@@ -1737,6 +2516,7 @@ int h3zero_callback_prepare_datagram(picoquic_cnx_t* cnx, void* context, size_t
 			}
 		}
 	}
+	still_active |= (h3_ctx->nb_queued_datagrams > 0);
 	if (!all_checked) {
 		/* The previous loops concluded without checking all prefixes, so recheck */
 		prefix_ctx = h3_ctx->stream_prefixes.first;
@@ -1768,6 +2548,58 @@ int h3zero_set_datagram_ready(picoquic_cnx_t* cnx, uint64_t stream_id)
 	return ret;
 }
 
+int h3zero_queue_datagram(picoquic_cnx_t* cnx, uint64_t stream_id, const uint8_t* bytes, size_t length)
+{
+	int ret = -1;
+	h3zero_callback_ctx_t* h3_ctx = (h3zero_callback_ctx_t*)picoquic_get_callback_context(cnx);
+
+	if (h3_ctx != NULL && length > 0) {
+		h3zero_stream_prefix_t* prefix_ctx = h3zero_find_stream_prefix(h3_ctx, stream_id);
+		size_t total_length = picoquic_frames_varint_encode_length(stream_id >> 2) + length;
+
+		if (prefix_ctx != NULL && prefix_ctx->nb_queued_datagrams < H3ZERO_DATAGRAM_QUEUE_MAX &&
+			total_length <= PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH &&
+			total_length <= picoquic_get_transport_parameters(cnx, 0)->max_datagram_frame_size) {
+			h3zero_queued_datagram_t* datagram = (h3zero_queued_datagram_t*)malloc(sizeof(h3zero_queued_datagram_t) + length);
+
+			if (datagram != NULL) {
+				memset(datagram, 0, sizeof(h3zero_queued_datagram_t));
+				datagram->data = ((uint8_t*)datagram) + sizeof(h3zero_queued_datagram_t);
+				datagram->length = length;
+				memcpy(datagram->data, bytes, length);
+				if (prefix_ctx->last_datagram == NULL) {
+					prefix_ctx->first_datagram = datagram;
+				}
+				else {
+					prefix_ctx->last_datagram->next = datagram;
+				}
+				prefix_ctx->last_datagram = datagram;
+				prefix_ctx->nb_queued_datagrams++;
+				h3_ctx->nb_queued_datagrams++;
+				ret = picoquic_mark_datagram_ready(cnx, 1);
+			}
+		}
+	}
+
+	return ret;
+}
+
+int h3zero_set_datagram_urgency(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t urgency)
+{
+	int ret = -1;
+	h3zero_callback_ctx_t* h3_ctx = (h3zero_callback_ctx_t*)picoquic_get_callback_context(cnx);
+
+	if (h3_ctx != NULL && urgency <= H3ZERO_PRIORITY_URGENCY_MAX) {
+		h3zero_stream_prefix_t* prefix_ctx = h3zero_find_stream_prefix(h3_ctx, stream_id);
+		if (prefix_ctx != NULL) {
+			prefix_ctx->datagram_urgency = urgency;
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
 /* Picoquic callback for H3 connections.
  */
 int h3zero_callback(picoquic_cnx_t* cnx,
@@ -1788,7 +2620,7 @@ int h3zero_callback(picoquic_cnx_t* cnx,
 		}
 		else {
 			picoquic_set_callback(cnx, h3zero_callback, ctx);
-			ret = h3zero_protocol_init(cnx);
+			ret = h3zero_protocol_init_ex(cnx, ctx);
 		}
 	} else{
 		ctx = (h3zero_callback_ctx_t*)callback_ctx;
@@ -1809,6 +2641,11 @@ int h3zero_callback(picoquic_cnx_t* cnx,
 				stream_ctx = h3zero_find_stream(ctx, stream_id);
 			}
 			if (stream_ctx != NULL) {
+				if (stream_ctx->is_h3 && IS_BIDIR_STREAM_ID(stream_id) && !stream_ctx->ps.stream_state.header_found &&
+					h3zero_qpack_decoder_cancel_stream(&ctx->qpack_decoder, stream_id) == 0) {
+					/* The header section will not be read, tell the peer's encoder */
+					(void)h3zero_qpack_send_instructions(cnx, ctx);
+				}
 				if (stream_ctx->path_callback != NULL) {
 					/* reset post callback. */
 					ret = stream_ctx->path_callback(cnx, NULL, 0, picohttp_callback_reset, stream_ctx, stream_ctx->path_callback_ctx);
@@ -2009,14 +2846,18 @@ void h3zero_release_capsule(h3zero_capsule_t* capsule)
 const uint8_t* h3zero_accumulate_capsule(const uint8_t* bytes, const uint8_t* bytes_max, h3zero_capsule_t* capsule)
 {
 	if (capsule->is_stored) {
-		/* reset the fields to expected value */
+		/* reset the fields to expected value, keeping the buffers */
 		capsule->header_length = 0;
 		capsule->header_read = 0;
+		capsule->value_read = 0;
 		capsule->capsule_type = 0;
 		capsule->capsule_length = 0;
+		capsule->capsule_value = NULL;
+		capsule->is_length_known = 0;
+		capsule->is_value_borrowed = 0;
 		capsule->is_stored = 0;
 	}
-	if (!capsule->is_length_known) {
+	if (!capsule->is_length_known && bytes < bytes_max) {
 		size_t length_of_type = 0;
 		size_t length_of_length = 0;
 
@@ -2055,31 +2896,45 @@ const uint8_t* h3zero_accumulate_capsule(const uint8_t* bytes, const uint8_t* by
 		}
 	}
 	if (capsule->is_length_known) {
-		if (capsule->capsule_buffer_size < capsule->capsule_length) {
-			uint8_t* capsule_buffer = (uint8_t*)malloc(capsule->capsule_length);
-			if (capsule_buffer != NULL && capsule->value_read > 0) {
-				memcpy(capsule_buffer, capsule->capsule_buffer, capsule->value_read);
+		size_t available = bytes_max - bytes;
+
+		if (capsule->value_read == 0 && available >= capsule->capsule_length &&
+			capsule->capsule_type == h3zero_capsule_type_datagram) {
+			/* The datagram is delivered directly from the input */
+			capsule->capsule_value = bytes;
+			capsule->is_value_borrowed = 1;
+			capsule->value_read = capsule->capsule_length;
+			bytes += capsule->capsule_length;
+			capsule->is_stored = 1;
+		}
+		else {
+			uint8_t* value_buffer = capsule->value_buffer;
+
+			if (capsule->capsule_length > H3ZERO_CAPSULE_BUFFER_SIZE) {
+				if (capsule->capsule_buffer_size < capsule->capsule_length) {
+					if (capsule->capsule_buffer != NULL) {
+						free(capsule->capsule_buffer);
+					}
+					capsule->capsule_buffer = (uint8_t*)malloc(capsule->capsule_length);
+					capsule->capsule_buffer_size = (capsule->capsule_buffer == NULL) ? 0 : capsule->capsule_length;
+				}
+				value_buffer = capsule->capsule_buffer;
 			}
-			if (capsule->capsule_buffer != NULL) {
-				free(capsule->capsule_buffer);
+			if (value_buffer == NULL) {
+				capsule->value_read = 0;
+				bytes = NULL;
 			}
-			capsule->capsule_buffer = capsule_buffer;
-			capsule->capsule_buffer_size = capsule->capsule_length;
-		}
-		if (capsule->capsule_buffer == NULL) {
-			capsule->value_read = 0;
-			capsule->capsule_buffer_size = 0;
-			bytes = NULL;
-		} else {
-			size_t available = bytes_max - bytes;
-			if (capsule->value_read + available > capsule->capsule_length) {
-				available = capsule->capsule_length - capsule->value_read;
-			}
-			memcpy(capsule->capsule_buffer + capsule->value_read, bytes, available);
-			bytes += available;
-			capsule->value_read += available;
-			if (capsule->value_read >= capsule->capsule_length) {
-				capsule->is_stored = 1;
+			else {
+				if (available > capsule->capsule_length - capsule->value_read) {
+					available = capsule->capsule_length - capsule->value_read;
+				}
+				memcpy(value_buffer + capsule->value_read, bytes, available);
+				bytes += available;
+				capsule->value_read += available;
+				if (capsule->value_read >= capsule->capsule_length) {
+					capsule->capsule_value = value_buffer;
+					capsule->is_stored = 1;
+				}
 			}
 		}
 	}
@@ -22,7 +22,11 @@
 #define H3ZERO_COMMON_H
 
 #include "picosplay.h"
+#include "picoradix.h"
 #include "h3zero.h"
+#include "h3zero_qpack.h"
+#include "h3zero_file_cache.h"
+#include "h3zero_response_cache.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -63,8 +67,40 @@ extern "C" {
         size_t path_length;
         picohttp_post_data_cb_fn path_callback;
         void* path_app_ctx;
+        unsigned int is_prefix : 1; /* Match all the paths starting with this path */
     } picohttp_server_path_item_t;
 
+    /* Routing of the requests to the path items.
+     *
+     * A path matches an exact item if it is equal to the item path, or if
+     * the item path is followed by a query string starting with '?'. If
+     * several exact items match, the first one in the table is selected.
+     * If no exact item matches, the longest prefix item is selected.
+     *
+     * The router is a trie of the item paths, compiled once from the path
+     * table so that the children of each node are contiguous and sorted by
+     * byte value. The lookup cost depends on the length of the path, not on
+     * the number of items. The router can be shared by all connections.
+     */
+    typedef struct st_h3zero_path_node_t {
+        uint32_t first_child;
+        uint16_t nb_children;
+        uint8_t byte;
+        int exact_item;
+        int prefix_item;
+    } h3zero_path_node_t;
+
+    typedef struct st_h3zero_path_router_t {
+        h3zero_path_node_t* nodes;
+        size_t nb_nodes;
+    } h3zero_path_router_t;
+
+    h3zero_path_router_t* h3zero_path_router_create(const picohttp_server_path_item_t* path_table, size_t path_table_nb);
+    void h3zero_path_router_delete(h3zero_path_router_t* router);
+    int h3zero_path_router_find(const h3zero_path_router_t* router, const uint8_t* path, size_t path_length);
+    /* Same result as h3zero_path_router_find, scanning the table */
+    int h3zero_find_path_item(const uint8_t* path, size_t path_length, const picohttp_server_path_item_t* path_table, size_t path_table_nb);
+
     /* Define stream context common to http 3 and http 09 callbacks
     */
 #define PICOHTTP_SERVER_FRAME_MAX 1024
@@ -101,12 +137,15 @@ extern "C" {
         uint64_t echo_length;
         uint64_t echo_sent;
         uint64_t post_received;
+        uint64_t stream_received; /* Bytes received on the stream, including frame headers */
+        uint64_t post_backlog; /* Body bytes passed to the path callback and not yet consumed, with backpressure */
         picohttp_post_data_cb_fn path_callback;
         void* path_callback_ctx;
         uint8_t frame[PICOHTTP_SERVER_FRAME_MAX];
         /* Client state management */
         unsigned int is_open : 1; /* The client has initiated this stream */
         unsigned int flow_opened : 1; /* Flow control parameters updated to allow receiving expected data */
+        unsigned int is_post_backpressure : 1; /* The path callback reports the body data it consumed */
         uint64_t received_length;
         uint64_t post_size;
         uint64_t post_sent;
@@ -115,6 +154,11 @@ extern "C" {
         /* File state variables, used by both cclient and server */
         char* file_path;
         FILE* F;
+        h3zero_file_source_t* file_source; /* Mapped file, if the server uses a file cache */
+        h3zero_response_body_t* response_body; /* Cached response, if the server uses a response cache */
+        /* Indexing and reuse of the context */
+        unsigned int is_indexed : 1;
+        struct st_h3zero_stream_ctx_t* next_pooled;
     } h3zero_stream_ctx_t;
 
     /* Parsing of a data stream. This is implemented as a filter, with a set of states:
@@ -136,12 +180,24 @@ extern "C" {
     void h3zero_delete_data_stream_state(h3zero_data_stream_state_t * stream_state);
 
     void* picohttp_stream_node_value(picosplay_node_t* node);
+    /* The tree shall be the h3_stream_tree of an h3zero_callback_ctx_t */
     void h3zero_init_stream_tree(picosplay_tree_t* h3_stream_tree);
 
     /* Handling of capsules */
 #define h3zero_capsule_type_datagram 0x00
 
 #define H3ZERO_CAPSULE_HEADER_SIZE_MAX 16
+    /* Capsules are parsed incrementally. Once a capsule is complete, is_stored
+     * is set and capsule_value points to its value:
+     * - a datagram capsule that arrives in a single piece is not copied,
+     *   capsule_value points to the data passed to h3zero_accumulate_capsule
+     *   and is only valid until that data is released,
+     * - other capsules up to H3ZERO_CAPSULE_BUFFER_SIZE bytes are reassembled
+     *   in the fixed value_buffer of the context,
+     * - larger capsules are reassembled in capsule_buffer, allocated on
+     *   demand and reused for the next capsules until the context is released.
+     */
+#define H3ZERO_CAPSULE_BUFFER_SIZE 1536
     typedef struct st_h3zero_capsule_t {
         uint8_t header_buffer[H3ZERO_CAPSULE_HEADER_SIZE_MAX];
         size_t header_length;
@@ -151,7 +207,10 @@ extern "C" {
         uint64_t capsule_type;
         size_t capsule_length;
         uint8_t* capsule_buffer;
+        const uint8_t* capsule_value;
+        uint8_t value_buffer[H3ZERO_CAPSULE_BUFFER_SIZE];
         unsigned int is_length_known:1;
+        unsigned int is_value_borrowed:1;
         unsigned int is_stored;
     } h3zero_capsule_t;
 
@@ -166,6 +225,17 @@ extern "C" {
 
     /* Handling of stream prefixes, for applications that use it.
      */
+    /* Datagram queued for a stream prefix. The data holds the HTTP
+     * Datagram Payload, the quarter stream ID is added when sending. */
+    typedef struct st_h3zero_queued_datagram_t {
+        struct st_h3zero_queued_datagram_t* next;
+        size_t length;
+        uint8_t* data;
+    } h3zero_queued_datagram_t;
+
+#define H3ZERO_DATAGRAM_QUEUE_MAX 64
+#define H3ZERO_STREAM_PREFIX_POOL_MAX 16
+
     typedef struct st_h3zero_stream_prefix_t {
         struct st_h3zero_stream_prefix_t* next;
         struct st_h3zero_stream_prefix_t* previous;
@@ -173,14 +243,34 @@ extern "C" {
         unsigned int ready_to_send_datagrams : 1;
         picohttp_post_data_cb_fn function_call;
         void* function_ctx;
+        /* Datagrams queued with h3zero_queue_datagram, sent by order of
+         * urgency (0 to 7, as in RFC 9218) before polling the prefixes */
+        uint8_t datagram_urgency;
+        h3zero_queued_datagram_t* first_datagram;
+        h3zero_queued_datagram_t* last_datagram;
+        size_t nb_queued_datagrams;
+        uint64_t nb_queued_datagrams_sent;
     } h3zero_stream_prefix_t;
 
     typedef struct st_h3zero_stream_prefixes_t {
         struct st_h3zero_stream_prefix_t* first;
         struct st_h3zero_stream_prefix_t* last;
+        /* Prefixes are stream IDs, indexed by stream type and rank. Prefixes
+         * that do not fit in the index are only found by scanning the list. */
+        picoradix_t prefix_index[4];
+        size_t nb_not_indexed;
+        /* Prefix contexts released by deleted sessions, kept for reuse */
+        struct st_h3zero_stream_prefix_t* pool;
+        size_t nb_pooled;
+        uint64_t nb_reused;
     } h3zero_stream_prefixes_t;
 
     int h3zero_protocol_init(picoquic_cnx_t* cnx);
+    /* Same as h3zero_protocol_init, but also advertises the QPACK dynamic
+     * table capacity set in the context, and sets up the QPACK decoder. */
+    int h3zero_protocol_init_ex(picoquic_cnx_t* cnx, struct st_h3zero_callback_ctx_t* ctx);
+    /* Send the instructions queued by the QPACK encoder and decoder */
+    int h3zero_qpack_send_instructions(picoquic_cnx_t* cnx, struct st_h3zero_callback_ctx_t* ctx);
 
     /* CLIENT DEFINITIONS 
      */
@@ -194,18 +284,44 @@ extern "C" {
         char const* web_folder;
         picohttp_server_path_item_t* path_table;
         size_t path_table_nb;
+        h3zero_path_router_t* path_router; /* Optional, compiled from the path table */
+        uint64_t qpack_table_capacity; /* Zero if the QPACK dynamic table is not used */
+        h3zero_file_cache_t* file_cache; /* Optional, shared by all connections */
+        h3zero_response_cache_t* response_cache; /* Optional, shared by all connections */
     } picohttp_server_parameters_t;
 
+#define H3ZERO_STREAM_CTX_POOL_MAX 16
+
     typedef struct st_h3zero_callback_ctx_t {
         picosplay_tree_t h3_stream_tree;
+        /* Stream contexts are indexed by stream type and rank. The tree is kept
+         * for ordered iteration, and for the streams that do not fit in the index. */
+        picoradix_t stream_index[4];
+        size_t nb_streams_not_indexed;
+        /* Stream contexts released by the connection, kept for reuse */
+        h3zero_stream_ctx_t* stream_ctx_pool;
+        size_t nb_pooled_stream_ctx;
+        uint64_t nb_stream_ctx_reused;
         picohttp_server_path_item_t * path_table;
         size_t path_table_nb;
+        h3zero_path_router_t* path_router;
         char const* web_folder;
         /* Settings */
         h3zero_settings_t settings;
+        /* QPACK dynamic table. The decoder does not accept blocked streams. */
+        uint64_t qpack_table_capacity;
+        uint64_t qpack_encoder_stream_id;
+        uint64_t qpack_decoder_stream_id;
+        h3zero_qpack_encoder_t qpack_encoder;
+        h3zero_qpack_decoder_t qpack_decoder;
+        h3zero_file_cache_t* file_cache;
+        h3zero_response_cache_t* response_cache;
         /* connection wide tracking of stream prefixes */
         h3zero_stream_prefixes_t stream_prefixes;
         uint64_t last_datagram_prefix;
+        uint64_t last_queued_datagram_prefix;
+        size_t nb_queued_datagrams;
+        uint64_t nb_datagram_frames_coalesced;
         /* Flag  and variables used by clients*/
         unsigned int no_disk : 1;
         unsigned int no_print : 1;
@@ -216,10 +332,27 @@ extern "C" {
     } h3zero_callback_ctx_t;
 
     h3zero_callback_ctx_t* h3zero_callback_create_context(picohttp_server_parameters_t* param);
+    /* Delete all the stream contexts, and free the index and the pool */
+    void h3zero_delete_all_streams(h3zero_callback_ctx_t* ctx);
     void h3zero_callback_delete_context(picoquic_cnx_t* cnx, h3zero_callback_ctx_t* ctx);
 
     int h3zero_post_data_or_fin(picoquic_cnx_t* cnx, uint8_t* bytes, size_t length, picoquic_call_back_event_t fin_or_event, h3zero_stream_ctx_t* stream_ctx);
 
+    /* Backpressure for the body of POST requests.
+     *
+     * By default, the flow control credit of the request stream is renewed as
+     * soon as the body data is passed to the path callback. A path callback
+     * that cannot process the data immediately calls h3zero_set_post_backpressure
+     * when it receives the picohttp_callback_post event. After that, the body
+     * data passed with picohttp_callback_post_data is counted as a backlog, and
+     * the callback reports the number of bytes it has drained, at any time,
+     * with h3zero_post_data_consumed. The MAX_STREAM_DATA updates are withheld
+     * while the backlog is not drained, so the memory used by a slow upload
+     * is bounded by the stream flow control window.
+     */
+    int h3zero_set_post_backpressure(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx);
+    int h3zero_post_data_consumed(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx, size_t length);
+
     void h3zero_delete_stream(picoquic_cnx_t * cnx, h3zero_callback_ctx_t* ctx, h3zero_stream_ctx_t* stream_ctx);
     
     h3zero_stream_ctx_t* h3zero_find_stream(h3zero_callback_ctx_t* ctx, 
@@ -232,6 +365,15 @@ extern "C" {
         int should_create,
         int is_h3);
 
+    /* RFC 9218 priorities: encoding and decoding of PRIORITY_UPDATE
+     * frames, and mapping of the request priority to the stream priority.
+     */
+    uint8_t* h3zero_create_priority_update_frame(uint8_t* bytes, uint8_t* bytes_max,
+        uint64_t stream_id, uint8_t urgency, int is_incremental);
+    int h3zero_parse_priority_update_frame(const uint8_t* bytes, const uint8_t* bytes_max,
+        uint64_t* stream_id, uint8_t* urgency, int* is_incremental);
+    int h3zero_apply_stream_priority(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx);
+
     uint8_t* h3zero_parse_incoming_remote_stream(
         uint8_t* bytes, uint8_t* bytes_max,
         h3zero_stream_ctx_t* stream_ctx,
@@ -244,6 +386,20 @@ extern "C" {
     int h3zero_set_datagram_ready(picoquic_cnx_t* cnx, uint64_t stream_id);
     void h3zero_receive_datagram_capsule(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx, h3zero_capsule_t* capsule, h3zero_callback_ctx_t* h3_ctx);
     uint8_t* h3zero_provide_datagram_buffer(void* context, size_t length, int ready_to_send);
+    /* Queue a datagram for the stream prefix, typically the control stream of
+     * a web transport session. The datagram is copied. The queued datagrams of
+     * all prefixes are sent first when the stack polls for datagrams, several
+     * of them in the same packet if they fit, before polling the prefixes
+     * marked with h3zero_set_datagram_ready. Returns -1 if the prefix is not
+     * declared, if the datagram is larger than the peer accepts, or if the
+     * queue of the prefix is full.
+     */
+    int h3zero_queue_datagram(picoquic_cnx_t* cnx, uint64_t stream_id, const uint8_t* bytes, size_t length);
+    /* Set the urgency of the datagrams queued for the prefix, from 0 (most urgent)
+     * to H3ZERO_PRIORITY_URGENCY_MAX. Prefixes of the same urgency are served
+     * round robin. The default is H3ZERO_PRIORITY_URGENCY_DEFAULT. */
+    int h3zero_set_datagram_urgency(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t urgency);
+    int h3zero_callback_prepare_datagram(picoquic_cnx_t* cnx, void* context, size_t space, h3zero_callback_ctx_t* h3_ctx);
 
     int h3zero_callback(picoquic_cnx_t* cnx,
         uint64_t stream_id, uint8_t* bytes, size_t length,
@@ -0,0 +1,303 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WINDOWS
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "picohash.h"
+#include "tls_api.h"
+#include "h3zero_file_cache.h"
+
+static uint64_t h3zero_file_source_hash(const void* key, const uint8_t* hash_seed)
+{
+    const h3zero_file_source_t* source = (const h3zero_file_source_t*)key;
+
+    return picohash_siphash((const uint8_t*)source->file_path, strlen(source->file_path), hash_seed);
+}
+
+static int h3zero_file_source_compare(const void* key1, const void* key2)
+{
+    const h3zero_file_source_t* source1 = (const h3zero_file_source_t*)key1;
+    const h3zero_file_source_t* source2 = (const h3zero_file_source_t*)key2;
+
+    return strcmp(source1->file_path, source2->file_path);
+}
+
+static picohash_item* h3zero_file_source_to_item(const void* key)
+{
+    h3zero_file_source_t* source = (h3zero_file_source_t*)key;
+
+    return &source->hash_item;
+}
+
+int h3zero_file_stat(char const* file_path, uint64_t* file_size, int64_t* modified_time)
+{
+#ifdef _WINDOWS
+    struct _stat64 st;
+    int ret = _stat64(file_path, &st);
+#else
+    struct stat st;
+    int ret = stat(file_path, &st);
+#endif
+
+    if (ret == 0) {
+        *file_size = (uint64_t)st.st_size;
+        *modified_time = (int64_t)st.st_mtime;
+    }
+
+    return ret;
+}
+
+/* Map the file in memory, with hints that it will be read sequentially
+ * and soon, so the kernel can start reading ahead. */
+static const uint8_t* h3zero_file_map(char const* file_path, size_t length)
+{
+    const uint8_t* data = NULL;
+#ifdef _WINDOWS
+    HANDLE file = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    if (file != INVALID_HANDLE_VALUE) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL) {
+            /* The view keeps a reference to the mapping */
+            data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, length);
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = open(file_path, O_RDONLY);
+
+    if (fd >= 0) {
+        void* mapped = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (mapped != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            (void)madvise(mapped, length, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+            (void)madvise(mapped, length, MADV_WILLNEED);
+#endif
+            data = (const uint8_t*)mapped;
+        }
+        close(fd);
+    }
+#endif
+    return data;
+}
+
+static void h3zero_file_unmap(const uint8_t* data, size_t length)
+{
+    if (data != NULL) {
+#ifdef _WINDOWS
+        (void)length;
+        UnmapViewOfFile(data);
+#else
+        munmap((void*)data, length);
+#endif
+    }
+}
+
+static void h3zero_file_source_free(h3zero_file_source_t* source)
+{
+    h3zero_file_unmap(source->data, source->length);
+    if (source->file_path != NULL) {
+        free(source->file_path);
+    }
+    free(source);
+}
+
+static void h3zero_file_cache_unlink(h3zero_file_cache_t* cache, h3zero_file_source_t* source)
+{
+    if (source->next_source == NULL) {
+        cache->last = source->previous_source;
+    }
+    else {
+        source->next_source->previous_source = source->previous_source;
+    }
+
+    if (source->previous_source == NULL) {
+        cache->first = source->next_source;
+    }
+    else {
+        source->previous_source->next_source = source->next_source;
+    }
+    source->previous_source = NULL;
+    source->next_source = NULL;
+}
+
+static void h3zero_file_cache_link_first(h3zero_file_cache_t* cache, h3zero_file_source_t* source)
+{
+    source->previous_source = NULL;
+    source->next_source = cache->first;
+    if (cache->first == NULL) {
+        cache->last = source;
+    }
+    else {
+        cache->first->previous_source = source;
+    }
+    cache->first = source;
+}
+
+/* Remove the source from the cache. The source is freed now if it is not
+ * referenced, or when the last reference is released. */
+static void h3zero_file_cache_remove(h3zero_file_cache_t* cache, h3zero_file_source_t* source)
+{
+    h3zero_file_cache_unlink(cache, source);
+    picohash_delete_key(cache->table, source, 0);
+    source->cache = NULL;
+    if (cache->nb_sources > 0) {
+        cache->nb_sources--;
+    }
+    if (source->ref_count <= 0) {
+        h3zero_file_source_free(source);
+    }
+}
+
+h3zero_file_cache_t* h3zero_file_cache_create(size_t max_sources, uint64_t max_file_size)
+{
+    h3zero_file_cache_t* cache = (h3zero_file_cache_t*)malloc(sizeof(h3zero_file_cache_t));
+
+    if (cache != NULL) {
+        memset(cache, 0, sizeof(h3zero_file_cache_t));
+        cache->max_sources = (max_sources == 0) ? H3ZERO_FILE_CACHE_DEFAULT_MAX_SOURCES : max_sources;
+        cache->max_file_size = (max_file_size == 0) ? H3ZERO_FILE_CACHE_DEFAULT_MAX_FILE_SIZE : max_file_size;
+        picoquic_public_random(cache->hash_seed, sizeof(cache->hash_seed));
+        cache->table = picohash_create_ex(cache->max_sources, h3zero_file_source_hash,
+            h3zero_file_source_compare, h3zero_file_source_to_item, cache->hash_seed);
+        if (cache->table == NULL) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    return cache;
+}
+
+void h3zero_file_cache_delete(h3zero_file_cache_t* cache)
+{
+    if (cache != NULL) {
+        while (cache->first != NULL) {
+            h3zero_file_cache_remove(cache, cache->first);
+        }
+        picohash_delete(cache->table, 0);
+        free(cache);
+    }
+}
+
+h3zero_file_source_t* h3zero_file_cache_open(h3zero_file_cache_t* cache, char const* file_path)
+{
+    h3zero_file_source_t* source = NULL;
+    h3zero_file_source_t key;
+    picohash_item* item;
+    uint64_t file_size = 0;
+    int64_t modified_time = 0;
+
+    if (cache == NULL || file_path == NULL ||
+        h3zero_file_stat(file_path, &file_size, &modified_time) != 0 || file_size > cache->max_file_size) {
+        return NULL;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.file_path = (char*)file_path;
+    item = picohash_retrieve(cache->table, &key);
+    if (item != NULL) {
+        source = (h3zero_file_source_t*)item->key;
+        if (source->length != file_size || source->modified_time != modified_time) {
+            /* The file changed since it was mapped */
+            h3zero_file_cache_remove(cache, source);
+            source = NULL;
+        }
+        else {
+            h3zero_file_cache_unlink(cache, source);
+            h3zero_file_cache_link_first(cache, source);
+            cache->nb_hits++;
+        }
+    }
+
+    if (source == NULL) {
+        /* Make room by evicting the least recently used sources that are not referenced */
+        h3zero_file_source_t* evicted = cache->last;
+
+        while (cache->nb_sources >= cache->max_sources && evicted != NULL) {
+            h3zero_file_source_t* previous = evicted->previous_source;
+            if (evicted->ref_count <= 0) {
+                h3zero_file_cache_remove(cache, evicted);
+            }
+            evicted = previous;
+        }
+
+        if (cache->nb_sources < cache->max_sources &&
+            (source = (h3zero_file_source_t*)malloc(sizeof(h3zero_file_source_t))) != NULL) {
+            size_t path_length = strlen(file_path);
+
+            memset(source, 0, sizeof(h3zero_file_source_t));
+            source->length = (size_t)file_size;
+            source->modified_time = modified_time;
+            source->file_path = (char*)malloc(path_length + 1);
+            if (source->file_path != NULL) {
+                memcpy(source->file_path, file_path, path_length + 1);
+            }
+            if (source->file_path == NULL ||
+                (source->length > 0 && (source->data = h3zero_file_map(file_path, source->length)) == NULL) ||
+                picohash_insert(cache->table, source) != 0) {
+                h3zero_file_source_free(source);
+                source = NULL;
+            }
+            else {
+                source->cache = cache;
+                h3zero_file_cache_link_first(cache, source);
+                cache->nb_sources++;
+                cache->nb_misses++;
+            }
+        }
+    }
+
+    if (source != NULL) {
+        source->ref_count++;
+    }
+
+    return source;
+}
+
+void h3zero_file_source_release(h3zero_file_source_t* source)
+{
+    if (source != NULL) {
+        source->ref_count--;
+        if (source->ref_count <= 0 && source->cache == NULL) {
+            h3zero_file_source_free(source);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef H3ZERO_FILE_CACHE_H
+#define H3ZERO_FILE_CACHE_H
+
+#include <stdint.h>
+#include "picohash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cache of open files, used by the server to send static content.
+ *
+ * Files are mapped in memory when first requested, with hints that the
+ * content will be read sequentially. The mapping is then shared by all
+ * streams and all connections that send the same file, so the data is
+ * copied directly from the page cache into the stream buffers, without
+ * a read call per chunk.
+ *
+ * Sources are reference counted. Sources that are not used by any stream
+ * stay in the cache, and the least recently used are unmapped when the
+ * cache is full. A cached source is dropped if the size or modification
+ * time of the file changed since it was mapped. Files shall not be
+ * truncated in place while they are being served.
+ *
+ * If the cache is full of referenced sources, or if the file is larger
+ * than the maximum size, h3zero_file_cache_open returns NULL and the
+ * caller falls back to regular file reads.
+ *
+ * The cache is not thread safe. It is meant to be shared by the
+ * connections handled by a single server loop.
+ */
+#define H3ZERO_FILE_CACHE_DEFAULT_MAX_SOURCES 64
+#define H3ZERO_FILE_CACHE_DEFAULT_MAX_FILE_SIZE (64ull * 1024ull * 1024ull)
+
+typedef struct st_h3zero_file_source_t {
+    picohash_item hash_item;
+    struct st_h3zero_file_cache_t* cache; /* NULL if no longer in the cache */
+    struct st_h3zero_file_source_t* previous_source;
+    struct st_h3zero_file_source_t* next_source;
+    char* file_path;
+    const uint8_t* data;
+    size_t length;
+    int64_t modified_time;
+    int ref_count;
+} h3zero_file_source_t;
+
+typedef struct st_h3zero_file_cache_t {
+    picohash_table* table;
+    h3zero_file_source_t* first; /* Most recently used */
+    h3zero_file_source_t* last;
+    size_t nb_sources;
+    size_t max_sources;
+    uint64_t max_file_size;
+    uint64_t nb_hits;
+    uint64_t nb_misses;
+    uint8_t hash_seed[16];
+} h3zero_file_cache_t;
+
+h3zero_file_cache_t* h3zero_file_cache_create(size_t max_sources, uint64_t max_file_size);
+void h3zero_file_cache_delete(h3zero_file_cache_t* cache);
+h3zero_file_source_t* h3zero_file_cache_open(h3zero_file_cache_t* cache, char const* file_path);
+void h3zero_file_source_release(h3zero_file_source_t* source);
+/* Size and modification time (in seconds since the epoch) of a file. Returns 0 on success. */
+int h3zero_file_stat(char const* file_path, uint64_t* file_size, int64_t* modified_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* H3ZERO_FILE_CACHE_H */
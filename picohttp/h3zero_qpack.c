@@ -0,0 +1,1178 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * QPACK dynamic table, encoder and decoder instructions, as defined in RFC 9204.
+ *
+ * The encoder stream carries the following instructions:
+ *
+ *   Set Dynamic Table Capacity: 001 Capacity(5+)
+ *   Insert with Name Reference: 1 T Name_Index(6+) H Value_Length(7+) Value
+ *   Insert with Literal Name: 01 H Name_Length(5+) Name H Value_Length(7+) Value
+ *   Duplicate: 000 Index(5+)
+ *
+ * The decoder stream carries the following instructions:
+ *
+ *   Section Acknowledgment: 1 Stream_ID(7+)
+ *   Stream Cancellation: 01 Stream_ID(6+)
+ *   Insert Count Increment: 00 Increment(6+)
+ *
+ * The field sections may contain references to the dynamic table, either
+ * relative to the base of the section or "post base":
+ *
+ *   Indexed Field Line: 1 T Index(6+), T=0 for dynamic table
+ *   Indexed Field Line with Post-Base Index: 0001 Index(4+)
+ *   Literal Field Line with Name Reference: 01 N T Name_Index(4+), T=0 for dynamic
+ *   Literal Field Line with Post-Base Name Reference: 0000 N Name_Index(3+)
+ *
+ * The encoder in h3zero never uses Huffman encoding, and only inserts
+ * entries with a static name reference or a literal name.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "h3zero.h"
+#include "h3zero_qpack.h"
+
+#define H3ZERO_QPACK_PREFIX_MAX 20
+
+extern h3zero_qpack_static_t qpack_static[];
+extern size_t h3zero_qpack_nb_static;
+
+/* Names of the headers, used when computing the size of entries inserted
+ * with a reference to the static table. */
+static const struct {
+    http_header_enum_t header;
+    char const * name;
+} h3zero_qpack_header_names[] = {
+    { http_pseudo_header_authority, ":authority" },
+    { http_pseudo_header_path, ":path" },
+    { http_header_age, "age" },
+    { http_header_content_disposition, "content-disposition" },
+    { http_header_content_length, "content-length" },
+    { http_header_cookie, "cookie" },
+    { http_header_date, "date" },
+    { http_header_etag, "etag" },
+    { http_header_if_modified_since, "if-modified-since" },
+    { http_header_if_none_match, "if-none-match" },
+    { http_header_last_modified, "last-modified" },
+    { http_header_link, "link" },
+    { http_header_location, "location" },
+    { http_header_referer, "referer" },
+    { http_header_set_cookie, "set-cookie" },
+    { http_pseudo_header_method, ":method" },
+    { http_pseudo_header_scheme, ":scheme" },
+    { http_pseudo_header_status, ":status" },
+    { http_pseudo_header_protocol, ":protocol" },
+    { http_header_accept, "accept" },
+    { http_header_accept_encoding, "accept-encoding" },
+    { http_header_accept_ranges, "accept-ranges" },
+    { http_header_access_control_allow_headers, "access-control-allow-headers" },
+    { http_header_access_control_allow_origin, "access-control-allow-origin" },
+    { http_header_cache_control, "cache-control" },
+    { http_header_content_encoding, "content-encoding" },
+    { http_header_content_type, "content-type" },
+    { http_header_range, "range" },
+    { http_header_strict_transport_security, "strict-transport-security" },
+    { http_header_vary, "vary" },
+    { http_header_x_content_type_options, "x-content-type-options" },
+    { http_header_x_xss_protection, "x-xss-protection" },
+    { http_header_accept_language, "accept-language" },
+    { http_header_access_control_allow_credentials, "access-control-allow-credentials" },
+    { http_header_access_control_allow_methods, "access-control-allow-methods" },
+    { http_header_access_control_expose_headers, "access-control-expose-headers" },
+    { http_header_access_control_request_headers, "access-control-request-headers" },
+    { http_header_access_control_request_method, "access-control-request-method" },
+    { http_header_alt_svc, "alt-svc" },
+    { http_header_authorization, "authorization" },
+    { http_header_content_security_policy, "content-security-policy" },
+    { http_header_early_data, "early-data" },
+    { http_header_expect_ct, "expect-ct" },
+    { http_header_forwarded, "forwarded" },
+    { http_header_if_range, "if-range" },
+    { http_header_origin, "origin" },
+    { http_header_purpose, "purpose" },
+    { http_header_server, "server" },
+    { http_header_timing_allow_origin, "timing-allow-origin" },
+    { http_header_upgrade_insecure_requests, "upgrade-insecure-requests" },
+    { http_header_user_agent, "user-agent" },
+    { http_header_x_forwarded_for, "x-forwarded-for" },
+    { http_header_x_frame_options, "x-frame-options" },
+    { http_header_priority, "priority" }
+};
+
+static const size_t h3zero_qpack_nb_header_names = sizeof(h3zero_qpack_header_names) / sizeof(h3zero_qpack_header_names[0]);
+
+char const * h3zero_qpack_header_name(http_header_enum_t header)
+{
+    char const * name = NULL;
+
+    for (size_t i = 0; i < h3zero_qpack_nb_header_names; i++) {
+        if (h3zero_qpack_header_names[i].header == header) {
+            name = h3zero_qpack_header_names[i].name;
+            break;
+        }
+    }
+
+    return name;
+}
+
+static http_header_enum_t h3zero_qpack_header_by_name(const uint8_t * name, size_t name_length)
+{
+    http_header_enum_t header = http_header_unknown;
+
+    for (size_t i = 0; i < h3zero_qpack_nb_header_names; i++) {
+        if (strlen(h3zero_qpack_header_names[i].name) == name_length &&
+            memcmp(h3zero_qpack_header_names[i].name, name, name_length) == 0) {
+            header = h3zero_qpack_header_names[i].header;
+            break;
+        }
+    }
+
+    return header;
+}
+
+/* Instruction buffers */
+static int h3zero_qpack_buffer_reserve(h3zero_qpack_buffer_t * buffer, size_t length)
+{
+    int ret = 0;
+
+    if (buffer->length + length > buffer->alloc) {
+        size_t new_alloc = (buffer->alloc == 0) ? 256 : 2 * buffer->alloc;
+        uint8_t * new_bytes;
+
+        while (new_alloc < buffer->length + length) {
+            new_alloc *= 2;
+        }
+        new_bytes = (uint8_t *)realloc(buffer->bytes, new_alloc);
+        if (new_bytes == NULL) {
+            ret = -1;
+        }
+        else {
+            buffer->bytes = new_bytes;
+            buffer->alloc = new_alloc;
+        }
+    }
+
+    return ret;
+}
+
+static int h3zero_qpack_buffer_append(h3zero_qpack_buffer_t * buffer, const uint8_t * bytes, size_t length)
+{
+    int ret = h3zero_qpack_buffer_reserve(buffer, length);
+
+    if (ret == 0 && length > 0) {
+        memcpy(buffer->bytes + buffer->length, bytes, length);
+        buffer->length += length;
+    }
+
+    return ret;
+}
+
+static int h3zero_qpack_buffer_append_int(h3zero_qpack_buffer_t * buffer, uint8_t prefix, uint8_t mask, uint64_t val)
+{
+    uint8_t coded[16];
+    uint8_t * bytes;
+
+    coded[0] = prefix;
+    bytes = h3zero_qpack_int_encode(coded, coded + sizeof(coded), mask, val);
+
+    return (bytes == NULL) ? -1 : h3zero_qpack_buffer_append(buffer, coded, bytes - coded);
+}
+
+/* Strings are Huffman encoded if that makes them shorter, so the
+ * encoded length is at most the length prefix plus the string length. */
+static int h3zero_qpack_buffer_append_string(h3zero_qpack_buffer_t * buffer, uint8_t prefix, uint8_t mask,
+    const uint8_t * string, size_t length)
+{
+    int ret = h3zero_qpack_buffer_reserve(buffer, length + 16);
+
+    if (ret == 0) {
+        uint8_t * bytes = buffer->bytes + buffer->length;
+        uint8_t * bytes_end = h3zero_qpack_string_encode(bytes, buffer->bytes + buffer->alloc,
+            prefix, mask, string, length);
+
+        if (bytes_end == NULL) {
+            ret = -1;
+        }
+        else {
+            buffer->length += bytes_end - bytes;
+        }
+    }
+
+    return ret;
+}
+
+static void h3zero_qpack_buffer_consume(h3zero_qpack_buffer_t * buffer, size_t consumed)
+{
+    if (consumed >= buffer->length) {
+        buffer->length = 0;
+    }
+    else if (consumed > 0) {
+        memmove(buffer->bytes, buffer->bytes + consumed, buffer->length - consumed);
+        buffer->length -= consumed;
+    }
+}
+
+static void h3zero_qpack_buffer_release(h3zero_qpack_buffer_t * buffer)
+{
+    if (buffer->bytes != NULL) {
+        free(buffer->bytes);
+    }
+    memset(buffer, 0, sizeof(h3zero_qpack_buffer_t));
+}
+
+/* Parsing of instructions that may be split across several stream frames.
+ * Returns 0 if the integer was decoded, 1 if more bytes are needed, -1 if
+ * the encoding is not valid. */
+static int h3zero_qpack_read_int(uint8_t * bytes, uint8_t * bytes_max, uint8_t mask, uint64_t * val, uint8_t ** next)
+{
+    int ret = 0;
+
+    if (bytes >= bytes_max) {
+        ret = 1;
+    }
+    else if ((*next = h3zero_qpack_int_decode(bytes, bytes_max, mask, val)) == NULL) {
+        ret = (bytes_max - bytes < 10) ? 1 : -1;
+    }
+
+    return ret;
+}
+
+static int h3zero_qpack_read_string(uint8_t * bytes, uint8_t * bytes_max, uint8_t huffman_bit, uint8_t mask,
+    uint8_t ** string, size_t * length, int * is_huffman, uint8_t ** next)
+{
+    uint64_t string_length = 0;
+    int ret = h3zero_qpack_read_int(bytes, bytes_max, mask, &string_length, next);
+
+    if (ret == 0) {
+        *is_huffman = (bytes[0] & huffman_bit) != 0;
+        if (string_length > (uint64_t)(bytes_max - *next)) {
+            ret = 1;
+        }
+        else {
+            *string = *next;
+            *length = (size_t)string_length;
+            *next += string_length;
+        }
+    }
+
+    return ret;
+}
+
+/* Dynamic table */
+static uint64_t h3zero_qpack_entry_size(const h3zero_qpack_entry_t * entry)
+{
+    return entry->name_length + entry->value_length + H3ZERO_QPACK_ENTRY_OVERHEAD;
+}
+
+static int h3zero_qpack_table_init(h3zero_qpack_table_t * table, uint64_t max_capacity)
+{
+    int ret = 0;
+
+    memset(table, 0, sizeof(h3zero_qpack_table_t));
+
+    if (max_capacity > 0) {
+        /* Each entry takes at least H3ZERO_QPACK_ENTRY_OVERHEAD bytes */
+        table->nb_alloc = (size_t)(max_capacity / H3ZERO_QPACK_ENTRY_OVERHEAD) + 1;
+        table->entries = (h3zero_qpack_entry_t **)calloc(table->nb_alloc, sizeof(h3zero_qpack_entry_t *));
+        if (table->entries == NULL) {
+            table->nb_alloc = 0;
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static void h3zero_qpack_table_drop(h3zero_qpack_table_t * table)
+{
+    size_t slot = (size_t)(table->dropped_count % table->nb_alloc);
+    h3zero_qpack_entry_t * entry = table->entries[slot];
+
+    if (entry != NULL) {
+        table->size -= h3zero_qpack_entry_size(entry);
+        free(entry);
+        table->entries[slot] = NULL;
+    }
+    table->dropped_count++;
+}
+
+static void h3zero_qpack_table_release(h3zero_qpack_table_t * table)
+{
+    while (table->dropped_count < table->insert_count) {
+        h3zero_qpack_table_drop(table);
+    }
+    if (table->entries != NULL) {
+        free(table->entries);
+    }
+    memset(table, 0, sizeof(h3zero_qpack_table_t));
+}
+
+h3zero_qpack_entry_t * h3zero_qpack_table_get(h3zero_qpack_table_t * table, uint64_t absolute_index)
+{
+    h3zero_qpack_entry_t * entry = NULL;
+
+    if (absolute_index >= table->dropped_count && absolute_index < table->insert_count) {
+        entry = table->entries[absolute_index % table->nb_alloc];
+    }
+
+    return entry;
+}
+
+static void h3zero_qpack_table_set_capacity(h3zero_qpack_table_t * table, uint64_t capacity)
+{
+    while (table->size > capacity && table->dropped_count < table->insert_count) {
+        h3zero_qpack_table_drop(table);
+    }
+    table->capacity = capacity;
+}
+
+static int h3zero_qpack_table_insert(h3zero_qpack_table_t * table, http_header_enum_t header,
+    const uint8_t * name, size_t name_length, const uint8_t * value, size_t value_length)
+{
+    int ret = 0;
+    uint64_t entry_size = (uint64_t)name_length + value_length + H3ZERO_QPACK_ENTRY_OVERHEAD;
+
+    if (table->nb_alloc == 0 || entry_size > table->capacity) {
+        ret = -1;
+    }
+    else {
+        h3zero_qpack_entry_t * entry = (h3zero_qpack_entry_t *)malloc(sizeof(h3zero_qpack_entry_t) + name_length + value_length);
+
+        if (entry == NULL) {
+            ret = -1;
+        }
+        else {
+            while (table->size + entry_size > table->capacity) {
+                h3zero_qpack_table_drop(table);
+            }
+            entry->header = header;
+            entry->name = (uint8_t *)(entry + 1);
+            entry->name_length = name_length;
+            entry->value = entry->name + name_length;
+            entry->value_length = value_length;
+            memcpy(entry->name, name, name_length);
+            memcpy(entry->value, value, value_length);
+            table->entries[table->insert_count % table->nb_alloc] = entry;
+            table->insert_count++;
+            table->size += entry_size;
+        }
+    }
+
+    return ret;
+}
+
+static int h3zero_qpack_table_find(h3zero_qpack_table_t * table, const uint8_t * name, size_t name_length,
+    const uint8_t * value, size_t value_length, uint64_t * absolute_index)
+{
+    int ret = -1;
+
+    for (uint64_t i = table->insert_count; i > table->dropped_count; i--) {
+        h3zero_qpack_entry_t * entry = table->entries[(i - 1) % table->nb_alloc];
+
+        if (entry->name_length == name_length && entry->value_length == value_length &&
+            memcmp(entry->name, name, name_length) == 0 && memcmp(entry->value, value, value_length) == 0) {
+            *absolute_index = i - 1;
+            ret = 0;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/* Encoder */
+int h3zero_qpack_encoder_init(h3zero_qpack_encoder_t * encoder, uint64_t capacity,
+    uint64_t peer_max_capacity, uint64_t peer_blocked_streams)
+{
+    int ret = 0;
+
+    memset(encoder, 0, sizeof(h3zero_qpack_encoder_t));
+
+    if (capacity > peer_max_capacity) {
+        capacity = peer_max_capacity;
+    }
+    encoder->max_entries = peer_max_capacity / H3ZERO_QPACK_ENTRY_OVERHEAD;
+    encoder->max_blocked_streams = peer_blocked_streams;
+
+    if ((ret = h3zero_qpack_table_init(&encoder->table, capacity)) == 0 && capacity > 0) {
+        encoder->table.capacity = capacity;
+        /* Set Dynamic Table Capacity */
+        ret = h3zero_qpack_buffer_append_int(&encoder->instructions, 0x20, 0x1F, capacity);
+    }
+
+    return ret;
+}
+
+void h3zero_qpack_encoder_release(h3zero_qpack_encoder_t * encoder)
+{
+    while (encoder->first_section != NULL) {
+        h3zero_qpack_section_t * section = encoder->first_section;
+        encoder->first_section = section->next;
+        free(section);
+    }
+    h3zero_qpack_table_release(&encoder->table);
+    h3zero_qpack_buffer_release(&encoder->instructions);
+    h3zero_qpack_buffer_release(&encoder->input);
+}
+
+int h3zero_qpack_encoder_is_blocking(h3zero_qpack_encoder_t * encoder, uint64_t stream_id)
+{
+    int is_blocking = 0;
+
+    for (h3zero_qpack_section_t * section = encoder->first_section; section != NULL; section = section->next) {
+        if (section->stream_id == stream_id && section->required_insert_count > encoder->known_received_count) {
+            is_blocking = 1;
+            break;
+        }
+    }
+
+    return is_blocking;
+}
+
+uint64_t h3zero_qpack_encoder_nb_blocking_streams(h3zero_qpack_encoder_t * encoder)
+{
+    uint64_t nb_blocking = 0;
+
+    for (h3zero_qpack_section_t * section = encoder->first_section; section != NULL; section = section->next) {
+        if (section->required_insert_count > encoder->known_received_count) {
+            h3zero_qpack_section_t * previous = encoder->first_section;
+
+            while (previous != section && (previous->stream_id != section->stream_id ||
+                previous->required_insert_count <= encoder->known_received_count)) {
+                previous = previous->next;
+            }
+            if (previous == section) {
+                nb_blocking++;
+            }
+        }
+    }
+
+    return nb_blocking;
+}
+
+/* Entries referenced by unacknowledged sections cannot be evicted */
+static uint64_t h3zero_qpack_encoder_min_reference(h3zero_qpack_encoder_t * encoder, uint64_t min_index)
+{
+    for (h3zero_qpack_section_t * section = encoder->first_section; section != NULL; section = section->next) {
+        if (section->min_index < min_index) {
+            min_index = section->min_index;
+        }
+    }
+
+    return min_index;
+}
+
+static int h3zero_qpack_encoder_can_insert(h3zero_qpack_encoder_t * encoder, uint64_t entry_size, uint64_t min_reference)
+{
+    h3zero_qpack_table_t * table = &encoder->table;
+    int can_insert = (entry_size <= table->capacity);
+
+    if (can_insert) {
+        uint64_t available = table->capacity - table->size;
+        uint64_t index = table->dropped_count;
+
+        while (available < entry_size) {
+            if (index >= min_reference || index >= table->insert_count) {
+                can_insert = 0;
+                break;
+            }
+            available += h3zero_qpack_entry_size(h3zero_qpack_table_get(table, index));
+            index++;
+        }
+    }
+
+    return can_insert;
+}
+
+typedef struct st_h3zero_qpack_section_state_t {
+    uint64_t base;
+    uint64_t required_insert_count;
+    uint64_t min_index;
+    int can_block;
+} h3zero_qpack_section_state_t;
+
+static uint8_t * h3zero_qpack_copy_line(uint8_t * bytes, uint8_t * bytes_max, const uint8_t * line, size_t line_length)
+{
+    if (bytes != NULL) {
+        if (bytes + line_length > bytes_max) {
+            bytes = NULL;
+        }
+        else {
+            memcpy(bytes, line, line_length);
+            bytes += line_length;
+        }
+    }
+
+    return bytes;
+}
+
+/* Copy a literal field line, Huffman encoding the value if that makes it
+ * shorter. The name part of the line is copied as is. */
+static uint8_t * h3zero_qpack_copy_literal(uint8_t * bytes, uint8_t * bytes_max, const uint8_t * line,
+    const uint8_t * value_line, const uint8_t * value, size_t value_length)
+{
+    bytes = h3zero_qpack_copy_line(bytes, bytes_max, line, value_line - line);
+
+    if (bytes != NULL) {
+        bytes = h3zero_qpack_string_encode(bytes, bytes_max, 0x00, 0x7F, value, value_length);
+    }
+
+    return bytes;
+}
+
+static uint8_t * h3zero_qpack_code_int(uint8_t * bytes, uint8_t * bytes_max, uint8_t prefix, uint8_t mask, uint64_t val)
+{
+    if (bytes != NULL) {
+        if (bytes >= bytes_max) {
+            bytes = NULL;
+        }
+        else {
+            *bytes = prefix;
+            bytes = h3zero_qpack_int_encode(bytes, bytes_max, mask, val);
+        }
+    }
+
+    return bytes;
+}
+
+/* Encode a literal field line with the dynamic table, inserting the field
+ * if it is not present yet. If the field cannot be referenced, copy the line. */
+static uint8_t * h3zero_qpack_encode_dynamic_field(h3zero_qpack_encoder_t * encoder, h3zero_qpack_section_state_t * state,
+    uint8_t * bytes, uint8_t * bytes_max, const uint8_t * line, const uint8_t * value_line,
+    int static_index, http_header_enum_t header, const uint8_t * name, size_t name_length,
+    const uint8_t * value, size_t value_length)
+{
+    uint64_t absolute_index = 0;
+    int is_found = (h3zero_qpack_table_find(&encoder->table, name, name_length, value, value_length, &absolute_index) == 0);
+
+    if (!is_found) {
+        uint64_t entry_size = (uint64_t)name_length + value_length + H3ZERO_QPACK_ENTRY_OVERHEAD;
+
+        if (h3zero_qpack_encoder_can_insert(encoder, entry_size, h3zero_qpack_encoder_min_reference(encoder, state->min_index)) &&
+            h3zero_qpack_table_insert(&encoder->table, header, name, name_length, value, value_length) == 0) {
+            int ret;
+
+            if (static_index >= 0) {
+                /* Insert with static name reference */
+                ret = h3zero_qpack_buffer_append_int(&encoder->instructions, 0xC0, 0x3F, (uint64_t)static_index);
+            }
+            else {
+                /* Insert with literal name */
+                ret = h3zero_qpack_buffer_append_string(&encoder->instructions, 0x40, 0x1F, name, name_length);
+            }
+            if (ret == 0) {
+                ret = h3zero_qpack_buffer_append_string(&encoder->instructions, 0x00, 0x7F, value, value_length);
+            }
+            if (ret != 0) {
+                bytes = NULL;
+            }
+            else {
+                absolute_index = encoder->table.insert_count - 1;
+                is_found = 1;
+            }
+        }
+    }
+
+    if (bytes != NULL) {
+        if (is_found && (absolute_index < encoder->known_received_count || state->can_block)) {
+            if (absolute_index < state->base) {
+                bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x80, 0x3F, state->base - 1 - absolute_index);
+            }
+            else {
+                bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x10, 0x0F, absolute_index - state->base);
+            }
+            if (absolute_index + 1 > state->required_insert_count) {
+                state->required_insert_count = absolute_index + 1;
+            }
+            if (absolute_index < state->min_index) {
+                state->min_index = absolute_index;
+            }
+        }
+        else {
+            bytes = h3zero_qpack_copy_literal(bytes, bytes_max, line, value_line, value, value_length);
+        }
+    }
+
+    return bytes;
+}
+
+static uint8_t * h3zero_qpack_encode_prefix(uint8_t * bytes, uint8_t * bytes_max,
+    h3zero_qpack_encoder_t * encoder, h3zero_qpack_section_state_t * state)
+{
+    if (state->required_insert_count == 0) {
+        bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x00, 0xFF, 0);
+        bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x00, 0x7F, 0);
+    }
+    else {
+        uint64_t encoded_insert_count = (state->required_insert_count % (2 * encoder->max_entries)) + 1;
+
+        bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x00, 0xFF, encoded_insert_count);
+        if (state->base >= state->required_insert_count) {
+            bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x00, 0x7F, state->base - state->required_insert_count);
+        }
+        else {
+            bytes = h3zero_qpack_code_int(bytes, bytes_max, 0x80, 0x7F, state->required_insert_count - state->base - 1);
+        }
+    }
+
+    return bytes;
+}
+
+uint8_t * h3zero_qpack_encode_section(h3zero_qpack_encoder_t * encoder, uint64_t stream_id,
+    uint8_t * section, uint8_t * section_max, uint8_t * bytes, uint8_t * bytes_max)
+{
+    h3zero_qpack_section_state_t state;
+    uint8_t * fields = bytes + H3ZERO_QPACK_PREFIX_MAX;
+    uint8_t * fields_end = fields;
+    uint8_t * in = section;
+    uint64_t val = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.base = encoder->table.insert_count;
+    state.min_index = UINT64_MAX;
+    state.can_block = h3zero_qpack_encoder_is_blocking(encoder, stream_id) ||
+        h3zero_qpack_encoder_nb_blocking_streams(encoder) < encoder->max_blocked_streams;
+
+    /* The section is expected to only use the static table */
+    if (bytes == NULL || fields >= bytes_max || in == NULL || in >= section_max || in[0] != 0) {
+        fields_end = NULL;
+    }
+    else {
+        in = h3zero_qpack_int_decode(in + 1, section_max, 0x7F, &val);
+    }
+
+    while (fields_end != NULL && in != NULL && in < section_max) {
+        uint8_t * line = in;
+
+        if ((in[0] & 0xC0) == 0xC0) {
+            /* Indexed field line, static table */
+            if ((in = h3zero_qpack_int_decode(in, section_max, 0x3F, &val)) != NULL) {
+                fields_end = h3zero_qpack_copy_line(fields_end, bytes_max, line, in - line);
+            }
+        }
+        else if ((in[0] & 0xD0) == 0x50 || (in[0] & 0xE0) == 0x20) {
+            /* Literal field line, with static name reference or with literal name */
+            int is_static_ref = (in[0] & 0xD0) == 0x50;
+            int never_index = (is_static_ref) ? (in[0] & 0x20) != 0 : (in[0] & 0x10) != 0;
+            int name_is_huffman = 0;
+            int value_is_huffman = 0;
+            http_header_enum_t header = http_header_unknown;
+            uint8_t const * name = NULL;
+            size_t name_length = 0;
+            uint8_t * value_line = NULL;
+            uint8_t * value = NULL;
+            size_t value_length = 0;
+            int static_index = -1;
+
+            if (is_static_ref) {
+                if ((in = h3zero_qpack_int_decode(in, section_max, 0x0F, &val)) != NULL) {
+                    if (val >= h3zero_qpack_nb_static ||
+                        (name = (uint8_t const *)h3zero_qpack_header_name(qpack_static[val].header)) == NULL) {
+                        in = NULL;
+                    }
+                    else {
+                        static_index = (int)val;
+                        header = qpack_static[val].header;
+                        name_length = strlen((char const *)name);
+                    }
+                }
+            }
+            else {
+                name_is_huffman = (in[0] & 0x08) != 0;
+                if ((in = h3zero_qpack_int_decode(in, section_max, 0x07, &val)) != NULL) {
+                    if (val > (uint64_t)(section_max - in)) {
+                        in = NULL;
+                    }
+                    else {
+                        name = in;
+                        name_length = (size_t)val;
+                        header = h3zero_qpack_header_by_name(name, name_length);
+                        in += name_length;
+                    }
+                }
+            }
+            if (in != NULL && in < section_max) {
+                value_line = in;
+                value_is_huffman = (in[0] & 0x80) != 0;
+                if ((in = h3zero_qpack_int_decode(in, section_max, 0x7F, &val)) != NULL) {
+                    if (val > (uint64_t)(section_max - in)) {
+                        in = NULL;
+                    }
+                    else {
+                        value = in;
+                        value_length = (size_t)val;
+                        in += value_length;
+                    }
+                }
+            }
+            else {
+                in = NULL;
+            }
+            if (in != NULL) {
+                if (name_is_huffman || value_is_huffman) {
+                    fields_end = h3zero_qpack_copy_line(fields_end, bytes_max, line, in - line);
+                }
+                else if (never_index || header == http_pseudo_header_path || header == http_header_range ||
+                    encoder->table.capacity == 0) {
+                    /* Values that change with each request are not worth inserting */
+                    fields_end = h3zero_qpack_copy_literal(fields_end, bytes_max, line, value_line, value, value_length);
+                }
+                else {
+                    fields_end = h3zero_qpack_encode_dynamic_field(encoder, &state, fields_end, bytes_max,
+                        line, value_line, static_index, header, name, name_length, value, value_length);
+                }
+            }
+        }
+        else {
+            /* Not a static field line */
+            in = NULL;
+        }
+    }
+
+    if (in == NULL || fields_end == NULL) {
+        bytes = NULL;
+    }
+    else {
+        uint8_t prefix[H3ZERO_QPACK_PREFIX_MAX];
+        uint8_t * prefix_end = h3zero_qpack_encode_prefix(prefix, prefix + sizeof(prefix), encoder, &state);
+
+        if (prefix_end == NULL) {
+            bytes = NULL;
+        }
+        else {
+            size_t prefix_length = prefix_end - prefix;
+            size_t fields_length = fields_end - fields;
+
+            memcpy(bytes, prefix, prefix_length);
+            memmove(bytes + prefix_length, fields, fields_length);
+            bytes += prefix_length + fields_length;
+
+            if (state.required_insert_count > 0) {
+                h3zero_qpack_section_t * section_ref = (h3zero_qpack_section_t *)malloc(sizeof(h3zero_qpack_section_t));
+
+                if (section_ref == NULL) {
+                    bytes = NULL;
+                }
+                else {
+                    h3zero_qpack_section_t ** last = &encoder->first_section;
+
+                    section_ref->next = NULL;
+                    section_ref->stream_id = stream_id;
+                    section_ref->required_insert_count = state.required_insert_count;
+                    section_ref->min_index = state.min_index;
+                    while (*last != NULL) {
+                        last = &(*last)->next;
+                    }
+                    *last = section_ref;
+                }
+            }
+        }
+    }
+
+    return bytes;
+}
+
+static uint64_t h3zero_qpack_encoder_section_ack(h3zero_qpack_encoder_t * encoder, uint64_t stream_id)
+{
+    uint64_t error_found = H3ZERO_QPACK_DECODER_STREAM_ERROR;
+    h3zero_qpack_section_t ** previous = &encoder->first_section;
+
+    while (*previous != NULL) {
+        h3zero_qpack_section_t * section = *previous;
+
+        if (section->stream_id == stream_id) {
+            if (section->required_insert_count > encoder->known_received_count) {
+                encoder->known_received_count = section->required_insert_count;
+            }
+            *previous = section->next;
+            free(section);
+            error_found = 0;
+            break;
+        }
+        previous = &section->next;
+    }
+
+    return error_found;
+}
+
+static void h3zero_qpack_encoder_stream_cancel(h3zero_qpack_encoder_t * encoder, uint64_t stream_id)
+{
+    h3zero_qpack_section_t ** previous = &encoder->first_section;
+
+    while (*previous != NULL) {
+        h3zero_qpack_section_t * section = *previous;
+
+        if (section->stream_id == stream_id) {
+            *previous = section->next;
+            free(section);
+        }
+        else {
+            previous = &section->next;
+        }
+    }
+}
+
+uint64_t h3zero_qpack_encoder_receive(h3zero_qpack_encoder_t * encoder, const uint8_t * bytes, size_t length)
+{
+    uint64_t error_found = 0;
+
+    if (h3zero_qpack_buffer_append(&encoder->input, bytes, length) != 0) {
+        error_found = H3ZERO_INTERNAL_ERROR;
+    }
+    else {
+        uint8_t * p = encoder->input.bytes;
+        uint8_t * p_max = p + encoder->input.length;
+
+        while (error_found == 0 && p < p_max) {
+            uint8_t * next = NULL;
+            uint64_t val = 0;
+            int status;
+
+            if ((p[0] & 0x80) == 0x80) {
+                /* Section Acknowledgment */
+                if ((status = h3zero_qpack_read_int(p, p_max, 0x7F, &val, &next)) == 0) {
+                    error_found = h3zero_qpack_encoder_section_ack(encoder, val);
+                }
+            }
+            else if ((p[0] & 0xC0) == 0x40) {
+                /* Stream Cancellation */
+                if ((status = h3zero_qpack_read_int(p, p_max, 0x3F, &val, &next)) == 0) {
+                    h3zero_qpack_encoder_stream_cancel(encoder, val);
+                }
+            }
+            else {
+                /* Insert Count Increment */
+                if ((status = h3zero_qpack_read_int(p, p_max, 0x3F, &val, &next)) == 0) {
+                    if (val == 0 || val > encoder->table.insert_count - encoder->known_received_count) {
+                        error_found = H3ZERO_QPACK_DECODER_STREAM_ERROR;
+                    }
+                    else {
+                        encoder->known_received_count += val;
+                    }
+                }
+            }
+
+            if (status < 0) {
+                error_found = H3ZERO_QPACK_DECODER_STREAM_ERROR;
+            }
+            else if (status > 0) {
+                break;
+            }
+            else {
+                p = next;
+            }
+        }
+        h3zero_qpack_buffer_consume(&encoder->input, p - encoder->input.bytes);
+    }
+
+    return error_found;
+}
+
+/* Decoder */
+int h3zero_qpack_decoder_init(h3zero_qpack_decoder_t * decoder, uint64_t max_capacity, uint64_t max_blocked_streams)
+{
+    memset(decoder, 0, sizeof(h3zero_qpack_decoder_t));
+    decoder->max_capacity = max_capacity;
+    decoder->max_entries = max_capacity / H3ZERO_QPACK_ENTRY_OVERHEAD;
+    decoder->max_blocked_streams = max_blocked_streams;
+
+    return h3zero_qpack_table_init(&decoder->table, max_capacity);
+}
+
+void h3zero_qpack_decoder_release(h3zero_qpack_decoder_t * decoder)
+{
+    h3zero_qpack_table_release(&decoder->table);
+    h3zero_qpack_buffer_release(&decoder->instructions);
+    h3zero_qpack_buffer_release(&decoder->input);
+}
+
+/* Copy a string from the encoder stream, decoding Huffman if needed.
+ * Huffman codes are at least 5 bits long. */
+static uint8_t * h3zero_qpack_decode_string(uint8_t * bytes, size_t length, int is_huffman, uint8_t * decoded, size_t * decoded_length)
+{
+    if (!is_huffman) {
+        memcpy(decoded, bytes, length);
+        *decoded_length = length;
+    }
+    else if (hzero_qpack_huffman_decode(bytes, bytes + length, decoded, (length * 8) / 5 + 1, decoded_length) != 0) {
+        decoded = NULL;
+    }
+
+    return decoded;
+}
+
+static uint64_t h3zero_qpack_decoder_insert(h3zero_qpack_decoder_t * decoder, h3zero_qpack_entry_t * name_entry,
+    http_header_enum_t header, uint8_t * name, size_t name_length, int name_is_huffman,
+    uint8_t * value, size_t value_length, int value_is_huffman)
+{
+    uint64_t error_found = 0;
+    size_t name_max = (name_is_huffman) ? (name_length * 8) / 5 + 1 : name_length;
+    size_t value_max = (value_is_huffman) ? (value_length * 8) / 5 + 1 : value_length;
+    /* Copy the name and value, because the insertion may evict the referenced entry */
+    uint8_t * buffer = (uint8_t *)malloc(name_max + value_max + 1);
+
+    if (buffer == NULL) {
+        error_found = H3ZERO_INTERNAL_ERROR;
+    }
+    else {
+        size_t decoded_name_length = 0;
+        size_t decoded_value_length = 0;
+
+        if (name_entry != NULL) {
+            header = name_entry->header;
+        }
+        if (h3zero_qpack_decode_string(name, name_length, name_is_huffman, buffer, &decoded_name_length) == NULL ||
+            h3zero_qpack_decode_string(value, value_length, value_is_huffman, buffer + decoded_name_length, &decoded_value_length) == NULL) {
+            error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+        }
+        else {
+            if (name_entry == NULL && header == http_header_unknown) {
+                header = h3zero_qpack_header_by_name(buffer, decoded_name_length);
+            }
+            if (h3zero_qpack_table_insert(&decoder->table, header, buffer, decoded_name_length,
+                buffer + decoded_name_length, decoded_value_length) != 0) {
+                error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+            }
+        }
+        free(buffer);
+    }
+
+    return error_found;
+}
+
+static h3zero_qpack_entry_t * h3zero_qpack_decoder_relative_entry(h3zero_qpack_decoder_t * decoder, uint64_t relative_index)
+{
+    h3zero_qpack_entry_t * entry = NULL;
+
+    if (relative_index < decoder->table.insert_count) {
+        entry = h3zero_qpack_table_get(&decoder->table, decoder->table.insert_count - 1 - relative_index);
+    }
+
+    return entry;
+}
+
+static int h3zero_qpack_decoder_instruction(h3zero_qpack_decoder_t * decoder, uint8_t * p, uint8_t * p_max,
+    uint8_t ** next, uint64_t * error_found)
+{
+    int status;
+    uint64_t val = 0;
+    uint8_t * name = NULL;
+    size_t name_length = 0;
+    int name_is_huffman = 0;
+    uint8_t * value = NULL;
+    size_t value_length = 0;
+    int value_is_huffman = 0;
+
+    if ((p[0] & 0x80) == 0x80) {
+        /* Insert with name reference */
+        int is_static = (p[0] & 0x40) != 0;
+
+        if ((status = h3zero_qpack_read_int(p, p_max, 0x3F, &val, next)) == 0 &&
+            (status = h3zero_qpack_read_string(*next, p_max, 0x80, 0x7F, &value, &value_length, &value_is_huffman, next)) == 0) {
+            if (is_static) {
+                char const * static_name = (val < h3zero_qpack_nb_static) ? h3zero_qpack_header_name(qpack_static[val].header) : NULL;
+
+                if (static_name == NULL) {
+                    *error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+                }
+                else {
+                    *error_found = h3zero_qpack_decoder_insert(decoder, NULL, qpack_static[val].header,
+                        (uint8_t *)static_name, strlen(static_name), 0, value, value_length, value_is_huffman);
+                }
+            }
+            else {
+                h3zero_qpack_entry_t * entry = h3zero_qpack_decoder_relative_entry(decoder, val);
+
+                if (entry == NULL) {
+                    *error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+                }
+                else {
+                    *error_found = h3zero_qpack_decoder_insert(decoder, entry, entry->header,
+                        entry->name, entry->name_length, 0, value, value_length, value_is_huffman);
+                }
+            }
+        }
+    }
+    else if ((p[0] & 0xC0) == 0x40) {
+        /* Insert with literal name */
+        if ((status = h3zero_qpack_read_string(p, p_max, 0x20, 0x1F, &name, &name_length, &name_is_huffman, next)) == 0 &&
+            (status = h3zero_qpack_read_string(*next, p_max, 0x80, 0x7F, &value, &value_length, &value_is_huffman, next)) == 0) {
+            *error_found = h3zero_qpack_decoder_insert(decoder, NULL, http_header_unknown,
+                name, name_length, name_is_huffman, value, value_length, value_is_huffman);
+        }
+    }
+    else if ((p[0] & 0xE0) == 0x20) {
+        /* Set dynamic table capacity */
+        if ((status = h3zero_qpack_read_int(p, p_max, 0x1F, &val, next)) == 0) {
+            if (val > decoder->max_capacity) {
+                *error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+            }
+            else {
+                h3zero_qpack_table_set_capacity(&decoder->table, val);
+            }
+        }
+    }
+    else {
+        /* Duplicate */
+        if ((status = h3zero_qpack_read_int(p, p_max, 0x1F, &val, next)) == 0) {
+            h3zero_qpack_entry_t * entry = h3zero_qpack_decoder_relative_entry(decoder, val);
+
+            if (entry == NULL) {
+                *error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+            }
+            else {
+                *error_found = h3zero_qpack_decoder_insert(decoder, entry, entry->header,
+                    entry->name, entry->name_length, 0, entry->value, entry->value_length, 0);
+            }
+        }
+    }
+
+    return status;
+}
+
+uint64_t h3zero_qpack_decoder_receive(h3zero_qpack_decoder_t * decoder, const uint8_t * bytes, size_t length)
+{
+    uint64_t error_found = 0;
+
+    if (h3zero_qpack_buffer_append(&decoder->input, bytes, length) != 0) {
+        error_found = H3ZERO_INTERNAL_ERROR;
+    }
+    else {
+        uint8_t * p = decoder->input.bytes;
+        uint8_t * p_max = p + decoder->input.length;
+
+        while (error_found == 0 && p < p_max) {
+            uint8_t * next = NULL;
+            int status = h3zero_qpack_decoder_instruction(decoder, p, p_max, &next, &error_found);
+
+            if (status < 0) {
+                error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+            }
+            else if (status > 0) {
+                /* A partial instruction cannot be larger than the table, allowing for Huffman encoding */
+                if ((uint64_t)(p_max - p) > 4 * decoder->max_capacity + H3ZERO_QPACK_ENTRY_OVERHEAD) {
+                    error_found = H3ZERO_QPACK_ENCODER_STREAM_ERROR;
+                }
+                break;
+            }
+            else {
+                p = next;
+            }
+        }
+        h3zero_qpack_buffer_consume(&decoder->input, p - decoder->input.bytes);
+
+        if (error_found == 0 && decoder->table.insert_count > decoder->known_received_count) {
+            /* Insert Count Increment */
+            if (h3zero_qpack_buffer_append_int(&decoder->instructions, 0x00, 0x3F,
+                decoder->table.insert_count - decoder->known_received_count) != 0) {
+                error_found = H3ZERO_INTERNAL_ERROR;
+            }
+            else {
+                decoder->known_received_count = decoder->table.insert_count;
+            }
+        }
+    }
+
+    return error_found;
+}
+
+uint8_t * h3zero_qpack_decode_prefix(uint8_t * bytes, uint8_t * bytes_max, h3zero_qpack_decoder_t * decoder,
+    uint64_t * required_insert_count, uint64_t * base)
+{
+    uint64_t encoded_insert_count = 0;
+    uint64_t delta_base = 0;
+    int is_negative = 0;
+
+    *required_insert_count = 0;
+    *base = 0;
+
+    if ((bytes = h3zero_qpack_int_decode(bytes, bytes_max, 0xFF, &encoded_insert_count)) != NULL && bytes < bytes_max) {
+        is_negative = (bytes[0] & 0x80) != 0;
+        bytes = h3zero_qpack_int_decode(bytes, bytes_max, 0x7F, &delta_base);
+    }
+    else {
+        bytes = NULL;
+    }
+
+    if (bytes != NULL && encoded_insert_count != 0) {
+        /* Reconstruct the required insert count, as specified in section 4.5.1.1 of RFC 9204 */
+        if (decoder == NULL || decoder->max_entries == 0 || encoded_insert_count > 2 * decoder->max_entries) {
+            bytes = NULL;
+        }
+        else {
+            uint64_t full_range = 2 * decoder->max_entries;
+            uint64_t max_value = decoder->table.insert_count + decoder->max_entries;
+            uint64_t max_wrapped = (max_value / full_range) * full_range;
+            uint64_t ric = max_wrapped + encoded_insert_count - 1;
+
+            if (ric > max_value) {
+                if (ric <= full_range) {
+                    bytes = NULL;
+                }
+                else {
+                    ric -= full_range;
+                }
+            }
+            if (ric == 0) {
+                bytes = NULL;
+            }
+            else if (is_negative) {
+                if (delta_base >= ric) {
+                    bytes = NULL;
+                }
+                else {
+                    *base = ric - delta_base - 1;
+                }
+            }
+            else {
+                *base = ric + delta_base;
+            }
+            *required_insert_count = ric;
+        }
+    }
+
+    return bytes;
+}
+
+int h3zero_qpack_decoder_acknowledge_section(h3zero_qpack_decoder_t * decoder, uint64_t stream_id, uint64_t required_insert_count)
+{
+    if (required_insert_count > decoder->known_received_count) {
+        decoder->known_received_count = required_insert_count;
+    }
+    /* Section Acknowledgment */
+    return h3zero_qpack_buffer_append_int(&decoder->instructions, 0x80, 0x7F, stream_id);
+}
+
+int h3zero_qpack_decoder_cancel_stream(h3zero_qpack_decoder_t * decoder, uint64_t stream_id)
+{
+    int ret = 0;
+
+    if (decoder->max_capacity > 0) {
+        /* Stream Cancellation */
+        ret = h3zero_qpack_buffer_append_int(&decoder->instructions, 0x40, 0x3F, stream_id);
+    }
+
+    return ret;
+}
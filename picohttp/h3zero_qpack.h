@@ -0,0 +1,165 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef H3ZERO_QPACK_H
+#define H3ZERO_QPACK_H
+
+#include "h3zero.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* QPACK dynamic table, as specified in RFC 9204.
+ *
+ * Each side of an H3 connection has an encoder and a decoder. The encoder
+ * mirrors the peer's dynamic table, and the decoder holds the table built
+ * from the instructions received on the peer's encoder stream. Both
+ * queue the instructions that they produce in an "instructions" buffer,
+ * which the application sends on the local encoder or decoder stream.
+ *
+ * The header frames are first prepared with the static table only, by
+ * the h3zero_create_xxx_header_frame functions. If the peer accepts a
+ * dynamic table, h3zero_qpack_encode_section rewrites the literal fields
+ * of that section as references to the dynamic table. The encoder only
+ * references entries that the peer has not acknowledged yet if that does
+ * not exceed the number of blocked streams allowed by the peer. The
+ * literal values that remain in the section, and the strings in the
+ * insert instructions, are Huffman encoded if that makes them shorter.
+ *
+ * The dynamic table is disabled if the capacity is zero, which is the
+ * default. The sections produced with the static table only are then
+ * sent as is.
+ */
+#define H3ZERO_QPACK_ENTRY_OVERHEAD 32
+#define H3ZERO_QPACK_DEFAULT_TABLE_CAPACITY 4096
+#define H3ZERO_QPACK_DEFAULT_BLOCKED_STREAMS 16
+
+typedef struct st_h3zero_qpack_entry_t {
+    http_header_enum_t header;
+    uint8_t * name;
+    size_t name_length;
+    uint8_t * value;
+    size_t value_length;
+} h3zero_qpack_entry_t;
+
+/* Entries are kept in a ring, indexed by their absolute index modulo the
+ * number of allocated entries. The entries from dropped_count to
+ * insert_count - 1 are present in the table. */
+typedef struct st_h3zero_qpack_table_t {
+    h3zero_qpack_entry_t ** entries;
+    size_t nb_alloc;
+    uint64_t insert_count;
+    uint64_t dropped_count;
+    uint64_t capacity;
+    uint64_t size;
+} h3zero_qpack_table_t;
+
+typedef struct st_h3zero_qpack_buffer_t {
+    uint8_t * bytes;
+    size_t length;
+    size_t alloc;
+} h3zero_qpack_buffer_t;
+
+/* Field sections sent with references to the dynamic table, and not yet
+ * acknowledged by the peer */
+typedef struct st_h3zero_qpack_section_t {
+    struct st_h3zero_qpack_section_t * next;
+    uint64_t stream_id;
+    uint64_t required_insert_count;
+    uint64_t min_index;
+} h3zero_qpack_section_t;
+
+typedef struct st_h3zero_qpack_encoder_t {
+    h3zero_qpack_table_t table;
+    uint64_t max_entries; /* Derived from the peer's max table capacity */
+    uint64_t max_blocked_streams;
+    uint64_t known_received_count;
+    h3zero_qpack_section_t * first_section;
+    h3zero_qpack_buffer_t instructions; /* To be sent on the encoder stream */
+    h3zero_qpack_buffer_t input; /* Partial instruction from the decoder stream */
+} h3zero_qpack_encoder_t;
+
+typedef struct st_h3zero_qpack_decoder_t {
+    h3zero_qpack_table_t table;
+    uint64_t max_capacity;
+    uint64_t max_entries;
+    uint64_t max_blocked_streams;
+    uint64_t nb_blocked_streams;
+    uint64_t known_received_count;
+    h3zero_qpack_buffer_t instructions; /* To be sent on the decoder stream */
+    h3zero_qpack_buffer_t input; /* Partial instruction from the encoder stream */
+} h3zero_qpack_decoder_t;
+
+char const * h3zero_qpack_header_name(http_header_enum_t header);
+
+h3zero_qpack_entry_t * h3zero_qpack_table_get(h3zero_qpack_table_t * table, uint64_t absolute_index);
+
+/* The encoder uses a table capacity no larger than the local capacity and
+ * the peer's maximum capacity. If that is not zero, the "set dynamic table
+ * capacity" instruction is queued. */
+int h3zero_qpack_encoder_init(h3zero_qpack_encoder_t * encoder, uint64_t capacity,
+    uint64_t peer_max_capacity, uint64_t peer_blocked_streams);
+void h3zero_qpack_encoder_release(h3zero_qpack_encoder_t * encoder);
+uint8_t * h3zero_qpack_encode_section(h3zero_qpack_encoder_t * encoder, uint64_t stream_id,
+    uint8_t * section, uint8_t * section_max, uint8_t * bytes, uint8_t * bytes_max);
+/* Process bytes received on the peer's decoder stream.
+ * Returns 0, or H3ZERO_QPACK_DECODER_STREAM_ERROR */
+uint64_t h3zero_qpack_encoder_receive(h3zero_qpack_encoder_t * encoder, const uint8_t * bytes, size_t length);
+int h3zero_qpack_encoder_is_blocking(h3zero_qpack_encoder_t * encoder, uint64_t stream_id);
+uint64_t h3zero_qpack_encoder_nb_blocking_streams(h3zero_qpack_encoder_t * encoder);
+
+int h3zero_qpack_decoder_init(h3zero_qpack_decoder_t * decoder, uint64_t max_capacity, uint64_t max_blocked_streams);
+void h3zero_qpack_decoder_release(h3zero_qpack_decoder_t * decoder);
+/* Process bytes received on the peer's encoder stream, and queue the
+ * insert count increment if new entries were added.
+ * Returns 0, or H3ZERO_QPACK_ENCODER_STREAM_ERROR */
+uint64_t h3zero_qpack_decoder_receive(h3zero_qpack_decoder_t * decoder, const uint8_t * bytes, size_t length);
+/* Parse the prefix of a field section. */
+uint8_t * h3zero_qpack_decode_prefix(uint8_t * bytes, uint8_t * bytes_max, h3zero_qpack_decoder_t * decoder,
+    uint64_t * required_insert_count, uint64_t * base);
+int h3zero_qpack_decoder_acknowledge_section(h3zero_qpack_decoder_t * decoder, uint64_t stream_id, uint64_t required_insert_count);
+int h3zero_qpack_decoder_cancel_stream(h3zero_qpack_decoder_t * decoder, uint64_t stream_id);
+
+/* Parse a header frame, using the dynamic table of the decoder if not NULL.
+ * If the section references entries not yet received, the function
+ * returns NULL and sets is_blocked. Sections that use the dynamic
+ * table are acknowledged on the decoder stream.
+ */
+uint8_t * h3zero_parse_qpack_header_frame_ex(uint8_t * bytes, uint8_t * bytes_max,
+    h3zero_header_parts_t * parts, h3zero_qpack_decoder_t * decoder, uint64_t stream_id,
+    uint64_t * required_insert_count, int * is_blocked);
+
+/* Same as h3zero_parse_qpack_header_frame_ex, but the values in the parts
+ * are borrowed views into the frame when possible. The frame buffer must
+ * remain valid until the parts are released; the caller may hand it over
+ * to the parts by setting parts->frame, in which case it is freed by
+ * h3zero_release_header_parts.
+ */
+uint8_t * h3zero_parse_qpack_header_frame_borrowed(uint8_t * bytes, uint8_t * bytes_max,
+    h3zero_header_parts_t * parts, h3zero_qpack_decoder_t * decoder, uint64_t stream_id,
+    uint64_t * required_insert_count, int * is_blocked);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* H3ZERO_QPACK_H */
@@ -0,0 +1,416 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "picoquic_utils.h"
+#include "picohash.h"
+#include "tls_api.h"
+#include "h3zero.h"
+#include "h3zero_file_cache.h"
+#include "h3zero_response_cache.h"
+
+static uint64_t h3zero_cached_response_hash(const void* key, const uint8_t* hash_seed)
+{
+    const h3zero_cached_response_t* response = (const h3zero_cached_response_t*)key;
+
+    return picohash_siphash(response->path, response->path_length, hash_seed);
+}
+
+static int h3zero_cached_response_compare(const void* key1, const void* key2)
+{
+    const h3zero_cached_response_t* response1 = (const h3zero_cached_response_t*)key1;
+    const h3zero_cached_response_t* response2 = (const h3zero_cached_response_t*)key2;
+
+    return (response1->path_length == response2->path_length &&
+        memcmp(response1->path, response2->path, response1->path_length) == 0) ? 0 : 1;
+}
+
+static picohash_item* h3zero_cached_response_to_item(const void* key)
+{
+    h3zero_cached_response_t* response = (h3zero_cached_response_t*)key;
+
+    return &response->hash_item;
+}
+
+h3zero_response_body_t* h3zero_response_body_reference(h3zero_response_body_t* body)
+{
+    if (body != NULL) {
+        body->ref_count++;
+    }
+    return body;
+}
+
+void h3zero_response_body_release(h3zero_response_body_t* body)
+{
+    if (body != NULL) {
+        body->ref_count--;
+        if (body->ref_count <= 0) {
+            free(body);
+        }
+    }
+}
+
+/* Load the whole file in a body buffer. The data is allocated
+ * together with the body structure. */
+static h3zero_response_body_t* h3zero_response_body_load(char const* file_path, size_t length)
+{
+    h3zero_response_body_t* body = (h3zero_response_body_t*)malloc(sizeof(h3zero_response_body_t) + length);
+
+    if (body != NULL) {
+        FILE* F = picoquic_file_open(file_path, "rb");
+        size_t nb_read = 0;
+
+        memset(body, 0, sizeof(h3zero_response_body_t));
+        body->data = (uint8_t*)(body + 1);
+        body->length = length;
+        body->ref_count = 1;
+
+        if (F != NULL) {
+            nb_read = fread(body->data, 1, length, F);
+            F = picoquic_file_close(F);
+        }
+        if (nb_read != length) {
+            free(body);
+            body = NULL;
+        }
+    }
+
+    return body;
+}
+
+/* Format the date in the IMF-fixdate format of RFC 9110, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT". The conversion from days to civil
+ * date does not depend on the time zone functions of the platform. */
+int h3zero_response_format_date(char* buf, size_t buf_len, int64_t seconds)
+{
+    static const char* day_name[7] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+    static const char* month_name[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    int64_t days;
+    int64_t secs;
+    int64_t z;
+    int64_t era;
+    int64_t doe;
+    int64_t yoe;
+    int64_t doy;
+    int64_t mp;
+    int64_t year;
+    int month;
+    int day;
+    size_t nb_chars = 0;
+
+    if (seconds < 0) {
+        seconds = 0;
+    }
+    days = seconds / 86400;
+    secs = seconds % 86400;
+    z = days + 719468;
+    era = z / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    month = (int)((mp < 10) ? mp + 3 : mp - 9);
+    year = yoe + era * 400 + ((month <= 2) ? 1 : 0);
+
+    return picoquic_sprintf(buf, buf_len, &nb_chars, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+        day_name[days % 7], day, month_name[month - 1], (int)year,
+        (int)(secs / 3600), (int)((secs / 60) % 60), (int)(secs % 60));
+}
+
+static void h3zero_cached_response_free(h3zero_cached_response_t* response)
+{
+    h3zero_response_body_release(response->body);
+    if (response->path != NULL) {
+        free(response->path);
+    }
+    if (response->file_path != NULL) {
+        free(response->file_path);
+    }
+    free(response);
+}
+
+static void h3zero_response_cache_unlink(h3zero_response_cache_t* cache, h3zero_cached_response_t* response)
+{
+    if (response->next_response == NULL) {
+        cache->last = response->previous_response;
+    }
+    else {
+        response->next_response->previous_response = response->previous_response;
+    }
+
+    if (response->previous_response == NULL) {
+        cache->first = response->next_response;
+    }
+    else {
+        response->previous_response->next_response = response->next_response;
+    }
+    response->previous_response = NULL;
+    response->next_response = NULL;
+}
+
+static void h3zero_response_cache_link_first(h3zero_response_cache_t* cache, h3zero_cached_response_t* response)
+{
+    response->previous_response = NULL;
+    response->next_response = cache->first;
+    if (cache->first == NULL) {
+        cache->last = response;
+    }
+    else {
+        cache->first->previous_response = response;
+    }
+    cache->first = response;
+}
+
+/* Remove the response from the cache. Streams that are sending the
+ * response keep their own reference to the body. */
+static void h3zero_response_cache_remove(h3zero_response_cache_t* cache, h3zero_cached_response_t* response)
+{
+    h3zero_response_cache_unlink(cache, response);
+    picohash_delete_key(cache->table, response, 0);
+    if (cache->nb_responses > 0) {
+        cache->nb_responses--;
+    }
+    cache->memory_used = (cache->memory_used > response->memory_size) ? cache->memory_used - response->memory_size : 0;
+    h3zero_cached_response_free(response);
+}
+
+h3zero_response_cache_t* h3zero_response_cache_create(size_t max_memory, uint64_t max_body_size,
+    uint64_t revalidate_interval)
+{
+    h3zero_response_cache_t* cache = (h3zero_response_cache_t*)malloc(sizeof(h3zero_response_cache_t));
+
+    if (cache != NULL) {
+        memset(cache, 0, sizeof(h3zero_response_cache_t));
+        cache->max_memory = (max_memory == 0) ? (size_t)H3ZERO_RESPONSE_CACHE_DEFAULT_MAX_MEMORY : max_memory;
+        cache->max_body_size = (max_body_size == 0) ? H3ZERO_RESPONSE_CACHE_DEFAULT_MAX_BODY_SIZE : max_body_size;
+        cache->revalidate_interval = (revalidate_interval == 0) ? H3ZERO_RESPONSE_CACHE_DEFAULT_REVALIDATE_INTERVAL : revalidate_interval;
+        picoquic_public_random(cache->hash_seed, sizeof(cache->hash_seed));
+        cache->table = picohash_create_ex(H3ZERO_RESPONSE_CACHE_NB_BINS, h3zero_cached_response_hash,
+            h3zero_cached_response_compare, h3zero_cached_response_to_item, cache->hash_seed);
+        if (cache->table == NULL) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    return cache;
+}
+
+void h3zero_response_cache_delete(h3zero_response_cache_t* cache)
+{
+    if (cache != NULL) {
+        while (cache->first != NULL) {
+            h3zero_response_cache_remove(cache, cache->first);
+        }
+        picohash_delete(cache->table, 0);
+        free(cache);
+    }
+}
+
+static h3zero_cached_response_t* h3zero_response_cache_find(h3zero_response_cache_t* cache,
+    uint8_t const* path, size_t path_length)
+{
+    h3zero_cached_response_t key;
+    picohash_item* item;
+
+    memset(&key, 0, sizeof(key));
+    key.path = (uint8_t*)path;
+    key.path_length = path_length;
+    item = picohash_retrieve(cache->table, &key);
+
+    return (item == NULL) ? NULL : (h3zero_cached_response_t*)item->key;
+}
+
+h3zero_cached_response_t* h3zero_response_cache_get(h3zero_response_cache_t* cache,
+    uint8_t const* path, size_t path_length, uint64_t current_time)
+{
+    h3zero_cached_response_t* response = NULL;
+
+    if (cache != NULL && path != NULL && (response = h3zero_response_cache_find(cache, path, path_length)) != NULL) {
+        if (current_time >= response->validated_time + cache->revalidate_interval) {
+            uint64_t file_size = 0;
+            int64_t modified_time = 0;
+
+            if (h3zero_file_stat(response->file_path, &file_size, &modified_time) != 0 ||
+                file_size != response->body->length || modified_time != response->modified_time) {
+                /* The file changed, or was removed */
+                h3zero_response_cache_remove(cache, response);
+                response = NULL;
+            }
+            else {
+                response->validated_time = current_time;
+            }
+        }
+        if (response != NULL) {
+            h3zero_response_cache_unlink(cache, response);
+            h3zero_response_cache_link_first(cache, response);
+            cache->nb_hits++;
+        }
+    }
+
+    return response;
+}
+
+h3zero_cached_response_t* h3zero_response_cache_add(h3zero_response_cache_t* cache,
+    uint8_t const* path, size_t path_length, char const* file_path,
+    h3zero_content_type_enum content_type, uint64_t current_time)
+{
+    h3zero_cached_response_t* response = NULL;
+    uint64_t file_size = 0;
+    int64_t modified_time = 0;
+    size_t file_path_length = (file_path == NULL) ? 0 : strlen(file_path);
+    size_t memory_size = sizeof(h3zero_cached_response_t) + sizeof(h3zero_response_body_t) + path_length + file_path_length + 1;
+
+    if (cache != NULL && path != NULL && file_path != NULL &&
+        h3zero_file_stat(file_path, &file_size, &modified_time) == 0 &&
+        file_size > 0 && file_size <= cache->max_body_size &&
+        memory_size + file_size <= cache->max_memory &&
+        (response = (h3zero_cached_response_t*)malloc(sizeof(h3zero_cached_response_t))) != NULL) {
+        size_t nb_chars = 0;
+        uint8_t* bytes;
+
+        memset(response, 0, sizeof(h3zero_cached_response_t));
+        response->path_length = path_length;
+        response->modified_time = modified_time;
+        response->validated_time = current_time;
+        response->memory_size = memory_size + (size_t)file_size;
+
+        if ((response->path = (uint8_t*)malloc(path_length + 1)) != NULL) {
+            memcpy(response->path, path, path_length);
+            response->path[path_length] = 0;
+        }
+        if ((response->file_path = (char*)malloc(file_path_length + 1)) != NULL) {
+            memcpy(response->file_path, file_path, file_path_length + 1);
+        }
+        if (response->path == NULL || response->file_path == NULL ||
+            (response->body = h3zero_response_body_load(file_path, (size_t)file_size)) == NULL ||
+            picoquic_sprintf(response->etag, sizeof(response->etag), &nb_chars, "\"%" PRIx64 "-%" PRIx64 "\"",
+                file_size, (uint64_t)modified_time) != 0 ||
+            h3zero_response_format_date(response->last_modified, sizeof(response->last_modified), modified_time) != 0) {
+            h3zero_cached_response_free(response);
+            response = NULL;
+        }
+        else {
+            /* Prepare the header sections once, for all the requests */
+            bytes = h3zero_create_validated_response_header_frame(response->header_section,
+                response->header_section + sizeof(response->header_section), 0, content_type,
+                H3ZERO_USER_AGENT_STRING, response->etag, response->last_modified);
+            response->header_length = (bytes == NULL) ? 0 : bytes - response->header_section;
+            bytes = h3zero_create_validated_response_header_frame(response->not_modified_section,
+                response->not_modified_section + sizeof(response->not_modified_section), 1, h3zero_content_type_none,
+                H3ZERO_USER_AGENT_STRING, response->etag, response->last_modified);
+            response->not_modified_length = (bytes == NULL) ? 0 : bytes - response->not_modified_section;
+            if (response->header_length == 0 || response->not_modified_length == 0) {
+                h3zero_cached_response_free(response);
+                response = NULL;
+            }
+        }
+    }
+
+    if (response != NULL) {
+        h3zero_cached_response_t* previous = h3zero_response_cache_find(cache, path, path_length);
+
+        if (previous != NULL) {
+            h3zero_response_cache_remove(cache, previous);
+        }
+        /* Evict the least recently used responses until the new one fits */
+        while (cache->memory_used + response->memory_size > cache->max_memory && cache->last != NULL) {
+            h3zero_response_cache_remove(cache, cache->last);
+        }
+        if (picohash_insert(cache->table, response) != 0) {
+            h3zero_cached_response_free(response);
+            response = NULL;
+        }
+        else {
+            h3zero_response_cache_link_first(cache, response);
+            cache->nb_responses++;
+            cache->memory_used += response->memory_size;
+            cache->nb_misses++;
+        }
+    }
+
+    return response;
+}
+
+/* Weak comparison of the entity tags listed in If-None-Match, as
+ * specified in RFC 9110 section 13.1.2 */
+static int h3zero_response_etag_match(char const* etag, uint8_t const* list, size_t list_length)
+{
+    size_t etag_length = strlen(etag);
+    size_t i = 0;
+    int is_match = 0;
+
+    while (i < list_length && !is_match) {
+        size_t start;
+        size_t end;
+
+        while (i < list_length && (list[i] == ' ' || list[i] == '\t' || list[i] == ',')) {
+            i++;
+        }
+        start = i;
+        while (i < list_length && list[i] != ',') {
+            i++;
+        }
+        end = i;
+        while (end > start && (list[end - 1] == ' ' || list[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start >= 2 && list[start] == 'W' && list[start + 1] == '/') {
+            start += 2;
+        }
+        if (end > start) {
+            is_match = (end - start == 1 && list[start] == '*') ||
+                (end - start == etag_length && memcmp(list + start, etag, etag_length) == 0);
+        }
+    }
+
+    return is_match;
+}
+
+int h3zero_response_cache_is_not_modified(h3zero_response_cache_t* cache,
+    h3zero_cached_response_t* response, h3zero_header_parts_t const* header)
+{
+    int is_not_modified = 0;
+
+    if (header->if_none_match != NULL) {
+        /* If-Modified-Since is ignored if If-None-Match is present */
+        is_not_modified = h3zero_response_etag_match(response->etag, header->if_none_match, header->if_none_match_length);
+    }
+    else if (header->if_modified_since != NULL) {
+        /* Exact match with the date sent in Last-Modified */
+        size_t date_length = strlen(response->last_modified);
+
+        is_not_modified = (header->if_modified_since_length == date_length &&
+            memcmp(header->if_modified_since, response->last_modified, date_length) == 0);
+    }
+
+    if (is_not_modified && cache != NULL) {
+        cache->nb_not_modified++;
+    }
+
+    return is_not_modified;
+}
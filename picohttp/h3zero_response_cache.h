@@ -0,0 +1,131 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef H3ZERO_RESPONSE_CACHE_H
+#define H3ZERO_RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include "picohash.h"
+#include "h3zero.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cache of complete responses to GET requests, used by the server.
+ *
+ * The first GET of a file found in the web folder loads the file content
+ * in a reference counted body buffer, and prepares the header sections of
+ * the "200" and "304" responses. These sections include an ETag computed
+ * from the file size and modification time, and the Last-Modified date.
+ * The following GET of the same path are served from the cache, without
+ * looking for the file, without opening it, and without encoding the
+ * headers again. If the QPACK dynamic table is used, the cached section
+ * is still rewritten with references to the dynamic table.
+ *
+ * Requests carrying an If-None-Match header matching the ETag, or an
+ * If-Modified-Since header exactly matching the Last-Modified date, get
+ * a "304" response without content.
+ *
+ * The cache checks whether the file changed at most once per revalidation
+ * interval. Changed entries are dropped, and loaded again from the file.
+ * The body buffers are shared by all streams sending the response, and are
+ * freed when the last stream releases them, even if the entry was evicted
+ * in the meantime. The memory used by the entries is capped, the least
+ * recently used entries being evicted first. Files larger than the maximum
+ * body size are not cached, and are served as before.
+ *
+ * The cache is not thread safe. It is meant to be shared by the
+ * connections handled by a single server loop.
+ */
+#define H3ZERO_RESPONSE_CACHE_DEFAULT_MAX_MEMORY (16ull * 1024ull * 1024ull)
+#define H3ZERO_RESPONSE_CACHE_DEFAULT_MAX_BODY_SIZE (1024ull * 1024ull)
+#define H3ZERO_RESPONSE_CACHE_DEFAULT_REVALIDATE_INTERVAL 1000000ull
+#define H3ZERO_RESPONSE_CACHE_NB_BINS 128
+#define H3ZERO_RESPONSE_SECTION_MAX 256
+#define H3ZERO_RESPONSE_ETAG_MAX 40
+#define H3ZERO_RESPONSE_DATE_MAX 32
+
+typedef struct st_h3zero_response_body_t {
+    int ref_count;
+    size_t length;
+    uint8_t* data;
+} h3zero_response_body_t;
+
+typedef struct st_h3zero_cached_response_t {
+    picohash_item hash_item;
+    struct st_h3zero_cached_response_t* previous_response;
+    struct st_h3zero_cached_response_t* next_response;
+    uint8_t* path;
+    size_t path_length;
+    char* file_path;
+    h3zero_response_body_t* body;
+    int64_t modified_time;
+    uint64_t validated_time;
+    size_t memory_size;
+    char etag[H3ZERO_RESPONSE_ETAG_MAX];
+    char last_modified[H3ZERO_RESPONSE_DATE_MAX];
+    size_t header_length;
+    size_t not_modified_length;
+    uint8_t header_section[H3ZERO_RESPONSE_SECTION_MAX];
+    uint8_t not_modified_section[H3ZERO_RESPONSE_SECTION_MAX];
+} h3zero_cached_response_t;
+
+typedef struct st_h3zero_response_cache_t {
+    picohash_table* table;
+    h3zero_cached_response_t* first; /* Most recently used */
+    h3zero_cached_response_t* last;
+    size_t nb_responses;
+    size_t memory_used;
+    size_t max_memory;
+    uint64_t max_body_size;
+    uint64_t revalidate_interval;
+    uint64_t nb_hits;
+    uint64_t nb_misses;
+    uint64_t nb_not_modified;
+    uint8_t hash_seed[16];
+} h3zero_response_cache_t;
+
+h3zero_response_cache_t* h3zero_response_cache_create(size_t max_memory, uint64_t max_body_size,
+    uint64_t revalidate_interval);
+void h3zero_response_cache_delete(h3zero_response_cache_t* cache);
+/* Find the response cached for a path. Returns NULL if the cache is NULL, if the
+ * path is not cached, or if the file changed since the response was loaded. */
+h3zero_cached_response_t* h3zero_response_cache_get(h3zero_response_cache_t* cache,
+    uint8_t const* path, size_t path_length, uint64_t current_time);
+/* Load the file found for a path, and add the response to the cache. */
+h3zero_cached_response_t* h3zero_response_cache_add(h3zero_response_cache_t* cache,
+    uint8_t const* path, size_t path_length, char const* file_path,
+    h3zero_content_type_enum content_type, uint64_t current_time);
+/* Check the conditional headers of the request against the validators of the response */
+int h3zero_response_cache_is_not_modified(h3zero_response_cache_t* cache,
+    h3zero_cached_response_t* response, h3zero_header_parts_t const* header);
+/* Format a date in seconds since the epoch as an HTTP IMF-fixdate */
+int h3zero_response_format_date(char* buf, size_t buf_len, int64_t seconds);
+h3zero_response_body_t* h3zero_response_body_reference(h3zero_response_body_t* body);
+void h3zero_response_body_release(h3zero_response_body_t* body);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* H3ZERO_RESPONSE_CACHE_H */
@@ -138,6 +138,68 @@ int demo_server_try_file_path(const uint8_t* path, size_t path_length, uint64_t*
     return ret;
 }
 
+/* Precompressed variants. If the client accepts an encoding and the web folder
+ * contains a sibling of the requested file with the matching suffix, such as
+ * "index.html.br", that sibling is served with the corresponding content-encoding.
+ * The server never compresses data itself. The codings are tried in order of
+ * decreasing compression ratio.
+ */
+static const struct {
+    h3zero_content_encoding_enum coding;
+    char const* suffix;
+} h3zero_server_encoded_variants[] = {
+    { h3zero_content_encoding_br, ".br" },
+    { h3zero_content_encoding_zstd, ".zst" },
+    { h3zero_content_encoding_gzip, ".gz" }
+};
+
+char const* h3zero_server_encoding_suffix(h3zero_content_encoding_enum content_encoding)
+{
+    char const* suffix = "";
+
+    for (size_t i = 0; i < sizeof(h3zero_server_encoded_variants) / sizeof(h3zero_server_encoded_variants[0]); i++) {
+        if (h3zero_server_encoded_variants[i].coding == content_encoding) {
+            suffix = h3zero_server_encoded_variants[i].suffix;
+            break;
+        }
+    }
+    return suffix;
+}
+
+int h3zero_server_try_encoded_path(const uint8_t* path, size_t path_length, uint8_t accept_encoding,
+    uint64_t* echo_size, char** file_path, char const* web_folder, int* file_error,
+    h3zero_content_encoding_enum* content_encoding)
+{
+    int ret = -1;
+    uint8_t* encoded_path;
+
+    *content_encoding = h3zero_content_encoding_identity;
+    if (path != NULL && path_length == 1 && path[0] == '/') {
+        path = (const uint8_t*)"/index.html";
+        path_length = 11;
+    }
+
+    if (accept_encoding != 0 && web_folder != NULL && path != NULL && path_length > 1 &&
+        (encoded_path = (uint8_t*)malloc(path_length + 8)) != NULL) {
+        memcpy(encoded_path, path, path_length);
+        for (size_t i = 0; ret != 0 && i < sizeof(h3zero_server_encoded_variants) / sizeof(h3zero_server_encoded_variants[0]); i++) {
+            if ((accept_encoding & H3ZERO_ACCEPT_ENCODING(h3zero_server_encoded_variants[i].coding)) != 0) {
+                size_t suffix_length = strlen(h3zero_server_encoded_variants[i].suffix);
+
+                memcpy(encoded_path + path_length, h3zero_server_encoded_variants[i].suffix, suffix_length);
+                if (demo_server_try_file_path(encoded_path, path_length + suffix_length, echo_size,
+                    file_path, web_folder, file_error) == 0) {
+                    *content_encoding = h3zero_server_encoded_variants[i].coding;
+                    ret = 0;
+                }
+            }
+        }
+        free(encoded_path);
+    }
+
+    return ret;
+}
+
 int h3zero_server_parse_path(const uint8_t * path, size_t path_length, uint64_t * echo_size, 
     char ** file_path, char const * web_folder, int * file_error)
 {
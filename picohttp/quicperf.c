@@ -645,6 +645,7 @@ quicperf_stream_ctx_t* quicperf_init_batch_stream_from_scenario(picoquic_cnx_t*
 
     if (stream_ctx != NULL) {
         stream_ctx->rep_number = rep_number;
+        stream_ctx->post_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
         stream_ctx->post_size = stream_desc->post_size;
         stream_ctx->response_size = stream_desc->response_size;
 
@@ -879,6 +880,7 @@ void quicperf_receive_datagram(picoquic_cnx_t* cnx, quicperf_ctx_t* ctx, const u
         if (rtt > report->max_delays) {
             report->max_delays = rtt;
         }
+        quicperf_histogram_add(&report->latency, rtt);
 
         if (ctx->report_file != NULL) {
             quicperf_set_report_file_header(ctx);
@@ -993,6 +995,15 @@ void quicperf_terminate_and_delete_stream(picoquic_cnx_t* cnx, quicperf_ctx_t* c
     int ret = 0;
 
     ctx->nb_open_streams--;
+    if (ctx->is_client && !stream_ctx->is_media && stream_ctx->stream_desc_index < ctx->nb_scenarios) {
+        uint64_t current_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+        uint64_t duration = (current_time > stream_ctx->post_time) ? current_time - stream_ctx->post_time : 0;
+
+        quicperf_histogram_add(&ctx->reports[stream_ctx->stream_desc_index].latency, duration);
+        if (ctx->load_ctx != NULL) {
+            quicperf_histogram_add(&ctx->load_ctx->request_latency, duration);
+        }
+    }
     if (ctx->is_client) {
         ret = quicperf_init_streams_after_completion(cnx, ctx, (size_t)stream_ctx->stream_desc_index, stream_ctx->rep_number, stream_ctx->group_id);
     }
@@ -1094,6 +1105,7 @@ void quicperf_receive_media_data(picoquic_cnx_t* cnx, quicperf_ctx_t* ctx, quicp
                     if (rtt > report->max_delays) {
                         report->max_delays = rtt;
                     }
+                    quicperf_histogram_add(&report->latency, rtt);
                 }
 
                 if (ctx->report_file != NULL) {
@@ -1607,6 +1619,132 @@ int quicperf_callback(picoquic_cnx_t* cnx,
     return ret;
 }
 
+/* Latency histograms, see quicperf.h.
+ */
+static size_t quicperf_histogram_index(uint64_t value)
+{
+    size_t index;
+
+    if (value < (1ull << QUICPERF_HISTOGRAM_SUB_BITS)) {
+        index = (size_t)value;
+    }
+    else if (value >= (1ull << QUICPERF_HISTOGRAM_MAX_BITS)) {
+        index = QUICPERF_HISTOGRAM_NB_BUCKETS - 1;
+    }
+    else {
+        /* Keep the SUB_BITS most significant bits of the value */
+        size_t shift = 1;
+
+        while ((value >> shift) >= (1ull << QUICPERF_HISTOGRAM_SUB_BITS)) {
+            shift++;
+        }
+        index = (shift << (QUICPERF_HISTOGRAM_SUB_BITS - 1)) + (size_t)(value >> shift);
+    }
+    return index;
+}
+
+static uint64_t quicperf_histogram_bucket_max(size_t index)
+{
+    uint64_t value;
+
+    if (index < (1u << QUICPERF_HISTOGRAM_SUB_BITS)) {
+        value = index;
+    }
+    else {
+        size_t shift = (index >> (QUICPERF_HISTOGRAM_SUB_BITS - 1)) - 1;
+        uint64_t top = (index & ((1u << (QUICPERF_HISTOGRAM_SUB_BITS - 1)) - 1)) + (1u << (QUICPERF_HISTOGRAM_SUB_BITS - 1));
+
+        value = ((top + 1) << shift) - 1;
+    }
+    return value;
+}
+
+void quicperf_histogram_add(quicperf_histogram_t* histogram, uint64_t value)
+{
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[quicperf_histogram_index(value)]++;
+}
+
+uint64_t quicperf_histogram_percentile(const quicperf_histogram_t* histogram, double percentile)
+{
+    uint64_t value = 0;
+
+    if (histogram->count > 0) {
+        if (percentile <= 0) {
+            value = histogram->min;
+        }
+        else if (percentile >= 100.0) {
+            value = histogram->max;
+        }
+        else {
+            /* Smallest bucket at which the cumulated count reaches the rank */
+            uint64_t rank = (uint64_t)((percentile * (double)histogram->count) / 100.0 + 0.999999);
+            uint64_t cumul = 0;
+            size_t index = 0;
+
+            if (rank < 1) {
+                rank = 1;
+            }
+            while (index < QUICPERF_HISTOGRAM_NB_BUCKETS - 1) {
+                cumul += histogram->buckets[index];
+                if (cumul >= rank) {
+                    break;
+                }
+                index++;
+            }
+            /* The last bucket holds all the values that are too large */
+            value = (index == QUICPERF_HISTOGRAM_NB_BUCKETS - 1) ? histogram->max : quicperf_histogram_bucket_max(index);
+            if (value > histogram->max) {
+                value = histogram->max;
+            }
+            if (value < histogram->min) {
+                value = histogram->min;
+            }
+        }
+    }
+    return value;
+}
+
+void quicperf_histogram_merge(quicperf_histogram_t* histogram, const quicperf_histogram_t* other)
+{
+    if (other->count > 0) {
+        if (histogram->count == 0 || other->min < histogram->min) {
+            histogram->min = other->min;
+        }
+        if (other->max > histogram->max) {
+            histogram->max = other->max;
+        }
+        histogram->count += other->count;
+        histogram->sum += other->sum;
+        for (size_t i = 0; i < QUICPERF_HISTOGRAM_NB_BUCKETS; i++) {
+            histogram->buckets[i] += other->buckets[i];
+        }
+    }
+}
+
+static char const* quicperf_report_id(quicperf_ctx_t* quicperf_ctx, size_t i, char* num_id, size_t num_id_size)
+{
+    const char* id = NULL;
+
+    if (quicperf_ctx->scenarios[i].id[0] != 0) {
+        id = quicperf_ctx->scenarios[i].id;
+    }
+    else {
+        size_t nb_chars = 0;
+        (void)picoquic_sprintf(num_id, num_id_size, &nb_chars, "#%zu", i);
+        num_id[num_id_size - 1] = 0;
+        id = num_id;
+    }
+    return id;
+}
+
 int quicperf_print_report(FILE* F, quicperf_ctx_t* quicperf_ctx)
 {
     int ret = 0;
@@ -1622,21 +1760,16 @@ int quicperf_print_report(FILE* F, quicperf_ctx_t* quicperf_ctx)
             continue;
         }
         
-        if (desc->id[0] != 0) {
-            id = desc->id;
-        }
-        else {
-            size_t nb_chars = 0;
-            (void)picoquic_sprintf(num_id, sizeof(num_id), &nb_chars, "#%zu", i);
-            num_id[31] = 0;
-            id = num_id;
-        }
+        id = quicperf_report_id(quicperf_ctx, i, num_id, sizeof(num_id));
         ret |= fprintf(F, "Quicperf scenario %s: received %" PRIu64 "/ %" PRIu64 " frames",
             id, report->nb_frames_received, total_frames) <= 0;
         if (ret == 0 && report->nb_frames_received > 0) {
             uint64_t average_delay = report->sum_delays / report->nb_frames_received;
             ret |= fprintf(F, ", delay min/average/max = %" PRIu64 "/ %" PRIu64 "/ %" PRIu64,
                 report->min_delays, average_delay, report->max_delays) <= 0;
+            ret |= fprintf(F, ", p50/p90/p99/p99.9 = %" PRIu64 "/ %" PRIu64 "/ %" PRIu64 "/ %" PRIu64,
+                quicperf_histogram_percentile(&report->latency, 50), quicperf_histogram_percentile(&report->latency, 90),
+                quicperf_histogram_percentile(&report->latency, 99), quicperf_histogram_percentile(&report->latency, 99.9)) <= 0;
         }
         if (ret == 0) {
             ret |= fprintf(F, ".\n");
@@ -1644,4 +1777,379 @@ int quicperf_print_report(FILE* F, quicperf_ctx_t* quicperf_ctx)
     }
 
     return ret;
-}
\ No newline at end of file
+}
+
+static int quicperf_print_json_histogram(FILE* F, const quicperf_histogram_t* histogram)
+{
+    int ret = 0;
+
+    ret |= fprintf(F, "{ \"count\": %" PRIu64, histogram->count) <= 0;
+    if (histogram->count > 0) {
+        ret |= fprintf(F, ", \"min\": %" PRIu64 ", \"mean\": %" PRIu64 ", \"max\": %" PRIu64,
+            histogram->min, histogram->sum / histogram->count, histogram->max) <= 0;
+        ret |= fprintf(F, ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p99_9\": %" PRIu64,
+            quicperf_histogram_percentile(histogram, 50), quicperf_histogram_percentile(histogram, 90),
+            quicperf_histogram_percentile(histogram, 99), quicperf_histogram_percentile(histogram, 99.9)) <= 0;
+    }
+    ret |= fprintf(F, " }") <= 0;
+
+    return ret;
+}
+
+/* Machine readable version of the report, one JSON object per connection.
+ * All latencies are in microseconds. The "latency" of a batch scenario
+ * is the duration of its requests, that of a media scenario is the delay
+ * of its frames. */
+int quicperf_print_json_report(FILE* F, quicperf_ctx_t* quicperf_ctx)
+{
+    int ret = 0;
+    static const char* media_type_name[] = { "batch", "stream", "datagram" };
+
+    ret |= fprintf(F, "{ \"nb_streams\": %" PRIu64 ", \"bytes_sent\": %" PRIu64 ", \"bytes_received\": %" PRIu64 ",\n  \"scenarios\": [",
+        quicperf_ctx->nb_streams, quicperf_ctx->data_sent, quicperf_ctx->data_received) <= 0;
+    for (size_t i = 0; ret == 0 && i < quicperf_ctx->nb_scenarios; i++) {
+        quicperf_stream_report_t* report = &quicperf_ctx->reports[i];
+        quicperf_stream_desc_t* desc = &quicperf_ctx->scenarios[i];
+        char num_id[32];
+        const char* id = quicperf_report_id(quicperf_ctx, i, num_id, sizeof(num_id));
+
+        ret |= fprintf(F, "%s\n    { \"id\": \"", (i == 0) ? "" : ",") <= 0;
+        for (const char* x = id; ret == 0 && *x != 0; x++) {
+            if (*x == '"' || *x == '\\') {
+                ret |= fputc('\\', F) == EOF;
+            }
+            ret |= fputc(*x, F) == EOF;
+        }
+        ret |= fprintf(F, "\", \"type\": \"%s\", \"repeat\": %" PRIu64,
+            media_type_name[desc->media_type], desc->repeat_count) <= 0;
+        if (desc->media_type != quicperf_media_batch) {
+            ret |= fprintf(F, ", \"frames_expected\": %" PRIu64 ", \"frames_received\": %" PRIu64,
+                desc->nb_frames * desc->repeat_count, report->nb_frames_received) <= 0;
+        }
+        ret |= fprintf(F, ", \"latency\": ") <= 0;
+        ret |= quicperf_print_json_histogram(F, &report->latency);
+        ret |= fprintf(F, " }") <= 0;
+    }
+    ret |= fprintf(F, " ] }\n") <= 0;
+
+    return ret;
+}
+
+/* Load generator, see quicperf.h.
+ */
+
+/* Exponentially distributed delay, for Poisson arrivals. The logarithm is
+ * computed with a short series, which is precise enough for this purpose,
+ * so as not to depend on the math library. */
+static uint64_t quicperf_load_random_exponential(uint64_t* random_context, uint64_t mean)
+{
+    /* uniform value in (0, 1] */
+    double x = ((double)(picoquic_test_random(random_context) >> 11) + 1.0) / 9007199254740992.0;
+    double minus_log = 0;
+    double z;
+    double z2;
+    double term;
+    double sum = 0;
+
+    /* x = m * 2^-k, with m in [0.5, 1) */
+    while (x < 0.5) {
+        x *= 2.0;
+        minus_log += 0.69314718055994531;
+    }
+    /* log(m) = 2 * atanh(z), with z = (m - 1)/(m + 1), |z| <= 1/3 */
+    z = (x - 1.0) / (x + 1.0);
+    z2 = z * z;
+    term = z;
+    for (int i = 1; i < 24; i += 2) {
+        sum += term / (double)i;
+        term *= z2;
+    }
+    minus_log -= 2.0 * sum;
+
+    return (uint64_t)(minus_log * (double)mean);
+}
+
+static void quicperf_load_schedule_next(quicperf_load_ctx_t* load_ctx)
+{
+    if (load_ctx->param.nb_connections != 0 && load_ctx->nb_arrivals >= load_ctx->param.nb_connections) {
+        load_ctx->next_arrival_time = UINT64_MAX;
+    }
+    else if (load_ctx->param.is_poisson) {
+        load_ctx->next_arrival_time += quicperf_load_random_exponential(&load_ctx->random_context,
+            1000000 / load_ctx->param.arrival_rate);
+    }
+    else {
+        /* Computed from the start time, so rounding errors do not accumulate */
+        load_ctx->next_arrival_time = load_ctx->start_time + (load_ctx->nb_arrivals * 1000000) / load_ctx->param.arrival_rate;
+    }
+}
+
+static int quicperf_load_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+    int ret = 0;
+    quicperf_load_cnx_t* load_cnx = (quicperf_load_cnx_t*)callback_ctx;
+
+    if (load_cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        if (fin_or_event == picoquic_callback_ready && !load_cnx->is_ready) {
+            uint64_t current_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+            load_cnx->is_ready = 1;
+            load_cnx->load_ctx->nb_handshakes++;
+            load_cnx->load_ctx->sum_handshake_time += current_time - load_cnx->arrival_time;
+        }
+        if (load_cnx->perf_ctx != NULL) {
+            ret = quicperf_callback(cnx, stream_id, bytes, length, fin_or_event, load_cnx->perf_ctx, v_stream_ctx);
+        }
+        if (fin_or_event == picoquic_callback_close ||
+            fin_or_event == picoquic_callback_application_close ||
+            fin_or_event == picoquic_callback_stateless_reset) {
+            /* quicperf_callback removed itself, keep the load context until the collection */
+            picoquic_set_callback(cnx, quicperf_load_callback, load_cnx);
+        }
+    }
+    return ret;
+}
+
+static void quicperf_load_cnx_delete(quicperf_load_ctx_t* load_ctx, quicperf_load_cnx_t* load_cnx)
+{
+    if (load_cnx->previous == NULL) {
+        load_ctx->first = load_cnx->next;
+    }
+    else {
+        load_cnx->previous->next = load_cnx->next;
+    }
+    if (load_cnx->next == NULL) {
+        load_ctx->last = load_cnx->previous;
+    }
+    else {
+        load_cnx->next->previous = load_cnx->previous;
+    }
+    if (load_cnx->cnx != NULL) {
+        picoquic_set_callback(load_cnx->cnx, NULL, NULL);
+        picoquic_delete_cnx(load_cnx->cnx);
+    }
+    if (load_cnx->perf_ctx != NULL) {
+        quicperf_delete_ctx(load_cnx->perf_ctx);
+    }
+    if (load_ctx->nb_open > 0) {
+        load_ctx->nb_open--;
+    }
+    free(load_cnx);
+}
+
+static int quicperf_load_start_cnx(quicperf_load_ctx_t* load_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    quicperf_load_cnx_t* load_cnx = (quicperf_load_cnx_t*)malloc(sizeof(quicperf_load_cnx_t));
+
+    if (load_cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(load_cnx, 0, sizeof(quicperf_load_cnx_t));
+        load_cnx->load_ctx = load_ctx;
+        load_cnx->arrival_time = current_time;
+        load_cnx->previous = load_ctx->last;
+        if (load_ctx->last == NULL) {
+            load_ctx->first = load_cnx;
+        }
+        else {
+            load_ctx->last->next = load_cnx;
+        }
+        load_ctx->last = load_cnx;
+        load_ctx->nb_open++;
+
+        if ((load_cnx->perf_ctx = quicperf_create_ctx(load_ctx->param.scenario_text, NULL)) == NULL ||
+            (load_cnx->cnx = picoquic_create_cnx(load_ctx->quic, picoquic_null_connection_id, picoquic_null_connection_id,
+                (struct sockaddr*)&load_ctx->param.server_address, current_time, load_ctx->param.proposed_version,
+                load_ctx->param.sni, (load_ctx->param.alpn == NULL) ? QUICPERF_ALPN : load_ctx->param.alpn, 1)) == NULL) {
+            ret = -1;
+        }
+        else {
+            load_cnx->perf_ctx->load_ctx = load_ctx;
+            picoquic_set_callback(load_cnx->cnx, quicperf_load_callback, load_cnx);
+            ret = picoquic_start_client_cnx(load_cnx->cnx);
+            if (ret == 0 && picoquic_is_0rtt_available(load_cnx->cnx)) {
+                /* Resumed with a ticket: start the scenario in 0-RTT */
+                load_ctx->nb_zero_rtt++;
+                ret = quicperf_init_streams_from_scenario(load_cnx->cnx, load_cnx->perf_ctx, "");
+            }
+        }
+        if (ret != 0) {
+            quicperf_load_cnx_delete(load_ctx, load_cnx);
+        }
+    }
+    return ret;
+}
+
+static void quicperf_load_collect_cnx(quicperf_load_ctx_t* load_ctx, quicperf_load_cnx_t* load_cnx, uint64_t current_time)
+{
+    quicperf_ctx_t* perf_ctx = load_cnx->perf_ctx;
+
+    if (load_cnx->is_ready && perf_ctx->nb_open_streams == 0 &&
+        picoquic_get_local_error(load_cnx->cnx) == 0 &&
+        picoquic_get_remote_error(load_cnx->cnx) == 0 &&
+        picoquic_get_application_error(load_cnx->cnx) == 0) {
+        load_ctx->nb_completed++;
+    }
+    else {
+        load_ctx->nb_failed++;
+    }
+    load_ctx->nb_requests += perf_ctx->nb_streams;
+    load_ctx->data_sent += perf_ctx->data_sent;
+    load_ctx->data_received += perf_ctx->data_received;
+    load_ctx->end_time = current_time;
+    quicperf_load_cnx_delete(load_ctx, load_cnx);
+}
+
+quicperf_load_ctx_t* quicperf_load_create(picoquic_quic_t* quic, const quicperf_load_param_t* param, uint64_t current_time)
+{
+    quicperf_load_ctx_t* load_ctx = NULL;
+    quicperf_ctx_t* check_ctx;
+
+    /* Check the scenario once, rather than failing each connection */
+    if (quic != NULL && param->arrival_rate > 0 && param->max_concurrent > 0 && param->scenario_text != NULL &&
+        (check_ctx = quicperf_create_ctx(param->scenario_text, NULL)) != NULL) {
+        quicperf_delete_ctx(check_ctx);
+        load_ctx = (quicperf_load_ctx_t*)malloc(sizeof(quicperf_load_ctx_t));
+        if (load_ctx != NULL) {
+            memset(load_ctx, 0, sizeof(quicperf_load_ctx_t));
+            load_ctx->quic = quic;
+            load_ctx->param = *param;
+            load_ctx->random_context = param->random_seed;
+            load_ctx->start_time = current_time;
+            load_ctx->next_arrival_time = current_time;
+            load_ctx->end_time = current_time;
+        }
+    }
+    return load_ctx;
+}
+
+void quicperf_load_delete(quicperf_load_ctx_t* load_ctx)
+{
+    if (load_ctx != NULL) {
+        while (load_ctx->first != NULL) {
+            quicperf_load_cnx_delete(load_ctx, load_ctx->first);
+        }
+        free(load_ctx);
+    }
+}
+
+int quicperf_load_step(quicperf_load_ctx_t* load_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    quicperf_load_cnx_t* load_cnx = load_ctx->first;
+
+    /* Collect the connections that ended */
+    while (load_cnx != NULL) {
+        quicperf_load_cnx_t* next = load_cnx->next;
+        if (picoquic_get_cnx_state(load_cnx->cnx) == picoquic_state_disconnected) {
+            quicperf_load_collect_cnx(load_ctx, load_cnx, current_time);
+        }
+        load_cnx = next;
+    }
+    /* Process the arrivals. In an open loop, arrivals that find the
+     * maximum number of connections open are refused, not delayed. */
+    while (ret == 0 && load_ctx->next_arrival_time <= current_time) {
+        load_ctx->nb_arrivals++;
+        if (load_ctx->nb_open >= load_ctx->param.max_concurrent) {
+            load_ctx->nb_refused++;
+        }
+        else if (quicperf_load_start_cnx(load_ctx, current_time) != 0) {
+            load_ctx->nb_failed++;
+        }
+        quicperf_load_schedule_next(load_ctx);
+    }
+    return ret;
+}
+
+uint64_t quicperf_load_next_time(quicperf_load_ctx_t* load_ctx)
+{
+    return load_ctx->next_arrival_time;
+}
+
+int quicperf_load_is_done(quicperf_load_ctx_t* load_ctx)
+{
+    return load_ctx->next_arrival_time == UINT64_MAX && load_ctx->first == NULL;
+}
+
+uint64_t quicperf_load_latency_percentile(quicperf_load_ctx_t* load_ctx, double percentile)
+{
+    return quicperf_histogram_percentile(&load_ctx->request_latency, percentile);
+}
+
+int quicperf_load_print_report(FILE* F, quicperf_load_ctx_t* load_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    uint64_t end_time = (load_ctx->first == NULL) ? load_ctx->end_time : current_time;
+    double duration_usec = (double)((end_time > load_ctx->start_time) ? end_time - load_ctx->start_time : 1);
+    double duration_sec = duration_usec / 1000000.0;
+
+    ret |= fprintf(F, "Load_duration_sec: %f\n", duration_sec) <= 0;
+    ret |= fprintf(F, "Connections_arrived: %" PRIu64 "\n", load_ctx->nb_arrivals) <= 0;
+    ret |= fprintf(F, "Connections_refused: %" PRIu64 "\n", load_ctx->nb_refused) <= 0;
+    ret |= fprintf(F, "Connections_completed: %" PRIu64 "\n", load_ctx->nb_completed) <= 0;
+    ret |= fprintf(F, "Connections_failed: %" PRIu64 "\n", load_ctx->nb_failed) <= 0;
+    ret |= fprintf(F, "Connections_zero_rtt: %" PRIu64 "\n", load_ctx->nb_zero_rtt) <= 0;
+    ret |= fprintf(F, "Handshake_rate: %f\n", ((double)load_ctx->nb_handshakes) / duration_sec) <= 0;
+    if (load_ctx->nb_handshakes > 0) {
+        ret |= fprintf(F, "Handshake_time_average_us: %" PRIu64 "\n", load_ctx->sum_handshake_time / load_ctx->nb_handshakes) <= 0;
+    }
+    ret |= fprintf(F, "Nb_transactions: %" PRIu64 "\n", load_ctx->nb_requests) <= 0;
+    ret |= fprintf(F, "Upload_Mbps: %f\n", ((double)load_ctx->data_sent) * 8.0 / duration_usec) <= 0;
+    ret |= fprintf(F, "Download_Mbps: %f\n", ((double)load_ctx->data_received) * 8.0 / duration_usec) <= 0;
+    if (load_ctx->request_latency.count > 0) {
+        ret |= fprintf(F, "Request_latency_us p50/p90/p99/p99.9/max: %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n",
+            quicperf_load_latency_percentile(load_ctx, 50), quicperf_load_latency_percentile(load_ctx, 90),
+            quicperf_load_latency_percentile(load_ctx, 99), quicperf_load_latency_percentile(load_ctx, 99.9),
+            load_ctx->request_latency.max) <= 0;
+    }
+
+    return ret;
+}
+
+int quicperf_load_print_json_report(FILE* F, quicperf_load_ctx_t* load_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    uint64_t end_time = (load_ctx->first == NULL) ? load_ctx->end_time : current_time;
+    uint64_t duration = (end_time > load_ctx->start_time) ? end_time - load_ctx->start_time : 0;
+
+    ret |= fprintf(F, "{ \"duration_us\": %" PRIu64 ", \"arrivals\": %" PRIu64 ", \"refused\": %" PRIu64,
+        duration, load_ctx->nb_arrivals, load_ctx->nb_refused) <= 0;
+    ret |= fprintf(F, ", \"completed\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"zero_rtt\": %" PRIu64,
+        load_ctx->nb_completed, load_ctx->nb_failed, load_ctx->nb_zero_rtt) <= 0;
+    ret |= fprintf(F, ", \"handshakes\": %" PRIu64 ", \"handshake_time_sum_us\": %" PRIu64,
+        load_ctx->nb_handshakes, load_ctx->sum_handshake_time) <= 0;
+    ret |= fprintf(F, ", \"transactions\": %" PRIu64 ", \"bytes_sent\": %" PRIu64 ", \"bytes_received\": %" PRIu64,
+        load_ctx->nb_requests, load_ctx->data_sent, load_ctx->data_received) <= 0;
+    ret |= fprintf(F, ",\n  \"request_latency\": ") <= 0;
+    ret |= quicperf_print_json_histogram(F, &load_ctx->request_latency);
+    ret |= fprintf(F, " }\n") <= 0;
+
+    return ret;
+}
+
+void quicperf_load_add_statistics(quicperf_load_ctx_t* total, const quicperf_load_ctx_t* load_ctx)
+{
+    if (total->start_time == 0 || load_ctx->start_time < total->start_time) {
+        total->start_time = load_ctx->start_time;
+    }
+    if (load_ctx->end_time > total->end_time) {
+        total->end_time = load_ctx->end_time;
+    }
+    total->nb_arrivals += load_ctx->nb_arrivals;
+    total->nb_refused += load_ctx->nb_refused;
+    total->nb_zero_rtt += load_ctx->nb_zero_rtt;
+    total->nb_handshakes += load_ctx->nb_handshakes;
+    total->sum_handshake_time += load_ctx->sum_handshake_time;
+    total->nb_completed += load_ctx->nb_completed;
+    total->nb_failed += load_ctx->nb_failed;
+    total->nb_requests += load_ctx->nb_requests;
+    total->data_sent += load_ctx->data_sent;
+    total->data_received += load_ctx->data_received;
+    quicperf_histogram_merge(&total->request_latency, &load_ctx->request_latency);
+}
@@ -63,12 +63,40 @@ typedef struct st_quicperf_stream_desc_t {
     int is_client_media;
 } quicperf_stream_desc_t;
 
+/* Latency histogram.
+ * The values are counted in log-linear buckets: the values below
+ * 2^QUICPERF_HISTOGRAM_SUB_BITS have a bucket each, and each power of two
+ * above that is split in 2^(QUICPERF_HISTOGRAM_SUB_BITS-1) buckets, so the
+ * percentiles are reported with about 3% precision. Values are in microseconds,
+ * and values above 2^QUICPERF_HISTOGRAM_MAX_BITS are counted in the last bucket.
+ * The exact min, max and sum are kept separately.
+ */
+#define QUICPERF_HISTOGRAM_SUB_BITS 6
+#define QUICPERF_HISTOGRAM_MAX_BITS 36
+#define QUICPERF_HISTOGRAM_NB_BUCKETS (((QUICPERF_HISTOGRAM_MAX_BITS - QUICPERF_HISTOGRAM_SUB_BITS + 2) << (QUICPERF_HISTOGRAM_SUB_BITS - 1)))
+
+typedef struct st_quicperf_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[QUICPERF_HISTOGRAM_NB_BUCKETS];
+} quicperf_histogram_t;
+
+void quicperf_histogram_add(quicperf_histogram_t* histogram, uint64_t value);
+/* Value at the specified percentile, e.g., 99.9. Returns the highest value
+ * of the bucket, capped by the max value actually recorded. */
+uint64_t quicperf_histogram_percentile(const quicperf_histogram_t* histogram, double percentile);
+void quicperf_histogram_merge(quicperf_histogram_t* histogram, const quicperf_histogram_t* other);
+
 typedef struct st_quicperf_stream_report_t {
     uint64_t stream_desc_index;
     uint64_t nb_frames_received;
     uint64_t sum_delays;
     uint64_t max_delays;
     uint64_t min_delays;
+    /* Frame delays of media scenarios, request durations of batch scenarios */
+    quicperf_histogram_t latency;
     uint64_t nb_groups_requested;
     uint64_t next_group_id;
     uint64_t next_group_start_time;
@@ -120,6 +148,8 @@ typedef struct st_quicperf_stream_ctx {
     unsigned int is_closed : 1;
 } quicperf_stream_ctx_t;
 
+struct st_quicperf_load_ctx_t;
+
 typedef struct st_quicperf_ctx_t {
     int is_client;
     int progress_observed;
@@ -148,6 +178,8 @@ typedef struct st_quicperf_ctx_t {
     uint64_t data_sent;
     uint64_t data_received;
     uint64_t nb_streams;
+    /* Set if the connection is part of a load test */
+    struct st_quicperf_load_ctx_t* load_ctx;
 } quicperf_ctx_t;
 
 quicperf_ctx_t* quicperf_create_ctx(const char* scenario_text, FILE* err_fd);
@@ -158,6 +190,89 @@ int quicperf_callback(picoquic_cnx_t* cnx,
     picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx);
 
 int quicperf_print_report(FILE* F, quicperf_ctx_t* quicperf_ctx);
+int quicperf_print_json_report(FILE* F, quicperf_ctx_t* quicperf_ctx);
+
+/* Load generator.
+ * The load generator opens client connections to a quicperf server following
+ * an open loop arrival model. Connections arrive at a constant rate, or as a
+ * Poisson process with the same average rate, regardless of the progress of
+ * the previous connections. An arrival is refused if max_concurrent
+ * connections are already open. Each connection runs the scenario with its
+ * own quicperf context. The next connections to the same server reuse the
+ * session tickets received by the QUIC context, and when 0-RTT is available
+ * they start the scenario before the end of the handshake.
+ *
+ * The application calls quicperf_load_step from its loop, at the latest at
+ * the time returned by quicperf_load_next_time. The step opens the
+ * connections that arrived and collects those that ended. The strings in
+ * the parameters must remain valid for the duration of the test. Datagram
+ * scenarios require the default transport parameters of the QUIC context
+ * to enable datagrams.
+ *
+ * The request latency is measured for the batch streams, from the creation
+ * of the stream to the end of the response.
+ */
+
+typedef struct st_quicperf_load_param_t {
+    char const* scenario_text;
+    char const* sni;
+    char const* alpn; /* QUICPERF_ALPN if NULL */
+    uint32_t proposed_version;
+    struct sockaddr_storage server_address;
+    uint64_t arrival_rate; /* connections per second */
+    size_t max_concurrent;
+    uint64_t nb_connections; /* number of arrivals, no limit if 0 */
+    int is_poisson;
+    uint64_t random_seed;
+} quicperf_load_param_t;
+
+typedef struct st_quicperf_load_cnx_t {
+    struct st_quicperf_load_cnx_t* next;
+    struct st_quicperf_load_cnx_t* previous;
+    struct st_quicperf_load_ctx_t* load_ctx;
+    picoquic_cnx_t* cnx;
+    quicperf_ctx_t* perf_ctx;
+    uint64_t arrival_time;
+    unsigned int is_ready : 1;
+} quicperf_load_cnx_t;
+
+typedef struct st_quicperf_load_ctx_t {
+    picoquic_quic_t* quic;
+    quicperf_load_param_t param;
+    quicperf_load_cnx_t* first;
+    quicperf_load_cnx_t* last;
+    size_t nb_open;
+    uint64_t random_context;
+    uint64_t start_time;
+    uint64_t next_arrival_time;
+    uint64_t end_time;
+    /* Statistics */
+    uint64_t nb_arrivals;
+    uint64_t nb_refused;
+    uint64_t nb_zero_rtt;
+    uint64_t nb_handshakes;
+    uint64_t sum_handshake_time;
+    uint64_t nb_completed;
+    uint64_t nb_failed;
+    uint64_t nb_requests;
+    uint64_t data_sent;
+    uint64_t data_received;
+    quicperf_histogram_t request_latency;
+} quicperf_load_ctx_t;
+
+quicperf_load_ctx_t* quicperf_load_create(picoquic_quic_t* quic, const quicperf_load_param_t* param, uint64_t current_time);
+void quicperf_load_delete(quicperf_load_ctx_t* load_ctx);
+int quicperf_load_step(quicperf_load_ctx_t* load_ctx, uint64_t current_time);
+uint64_t quicperf_load_next_time(quicperf_load_ctx_t* load_ctx);
+int quicperf_load_is_done(quicperf_load_ctx_t* load_ctx);
+/* Latency at the specified percentile, in microseconds */
+uint64_t quicperf_load_latency_percentile(quicperf_load_ctx_t* load_ctx, double percentile);
+int quicperf_load_print_report(FILE* F, quicperf_load_ctx_t* load_ctx, uint64_t current_time);
+int quicperf_load_print_json_report(FILE* F, quicperf_load_ctx_t* load_ctx, uint64_t current_time);
+/* When running one load context per thread, add the statistics of a
+ * finished load context to those of a total, initialized to zero. The
+ * total can then be printed with the report functions. */
+void quicperf_load_add_statistics(quicperf_load_ctx_t* total, const quicperf_load_ctx_t* load_ctx);
 
 #ifdef __cplusplus
 }
@@ -398,7 +398,7 @@ int picowt_receive_capsule(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx,
                     }
                     else {
                         capsule->error_msg = picoquic_frames_uint32_decode(
-                            capsule->h3_capsule.capsule_buffer, capsule->h3_capsule.capsule_buffer + capsule->h3_capsule.capsule_length,
+                            capsule->h3_capsule.capsule_value, capsule->h3_capsule.capsule_value + capsule->h3_capsule.capsule_length,
                             &capsule->error_code);
                         capsule->error_msg_len = capsule->h3_capsule.capsule_length - 4;
                     }
@@ -123,6 +123,27 @@ int wt_baton_close_session(picoquic_cnx_t* cnx, wt_baton_ctx_t* baton_ctx, uint3
     return(ret);
 }
 
+/* Close the connection when the client session is closed. In
+ * benchmark mode, wait until all the sessions are closed. */
+static int wt_baton_client_session_closed(picoquic_cnx_t* cnx, wt_baton_ctx_t* baton_ctx)
+{
+    int ret = 0;
+    wt_baton_bench_t* bench = baton_ctx->bench;
+
+    if (bench == NULL) {
+        ret = picoquic_close(cnx, 0);
+    }
+    else if (!baton_ctx->is_bench_closed) {
+        baton_ctx->is_bench_closed = 1;
+        bench->nb_sessions_closed++;
+        if (bench->nb_sessions_closed >= bench->nb_sessions) {
+            bench->end_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+            ret = picoquic_close(cnx, 0);
+        }
+    }
+    return ret;
+}
+
 /* Update context when sending a connect request */
 int wt_baton_connecting(picoquic_cnx_t* cnx,
     h3zero_stream_ctx_t* stream_ctx, void * v_baton_ctx)
@@ -194,6 +215,7 @@ int wt_baton_check(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx,
     size_t lane_id = SIZE_MAX;
     size_t available_lane = SIZE_MAX;
 
+    baton_ctx->nb_batons_received++;
     for (size_t i = 0; i < baton_ctx->nb_lanes; i++) {
         /* TODO: maybe store expected value if known */
         /* Looking first for direct match */
@@ -201,6 +223,10 @@ int wt_baton_check(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx,
             if ((uint8_t)(baton_ctx->lanes[i].baton + 1) == baton_received) {
                 /* matches expected echo of last sent baton */
                 baton_ctx->lanes[i].baton_state = wt_baton_state_sending;
+                if (baton_ctx->bench != NULL) {
+                    uint64_t current_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+                    quicperf_histogram_add(&baton_ctx->bench->latency, current_time - baton_ctx->lanes[i].send_time);
+                }
                 lane_id = i;
                 break;
             }
@@ -242,7 +268,13 @@ int wt_baton_check(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx,
         } else {
             int baton_7 = baton_received % 7;
 
-            if (baton_7 == picoquic_is_client(cnx) && baton_received != 0) {
+            if (baton_ctx->datagrams_per_turn > 0) {
+                baton_ctx->nb_datagrams_pending += baton_ctx->datagrams_per_turn;
+                baton_ctx->is_datagram_ready = 1;
+                baton_ctx->baton_datagram_send_next = baton_received;
+                h3zero_set_datagram_ready(cnx, baton_ctx->control_stream_id);
+            }
+            else if (baton_7 == picoquic_is_client(cnx) && baton_received != 0) {
                 baton_ctx->is_datagram_ready = 1;
                 baton_ctx->baton_datagram_send_next = baton_received;
                 h3zero_set_datagram_ready(cnx, baton_ctx->control_stream_id);
@@ -348,7 +380,7 @@ int wt_baton_stream_data(picoquic_cnx_t* cnx,
             stream_ctx->ps.stream_state.is_fin_received = 1;
             baton_ctx->baton_state = wt_baton_state_closed;
             if (baton_ctx->is_client) {
-                ret = picoquic_close(cnx, 0);
+                ret = wt_baton_client_session_closed(cnx, baton_ctx);
             }
             else {
                 h3zero_delete_stream_prefix(cnx, baton_ctx->h3_ctx, stream_ctx->stream_id);
@@ -486,7 +518,14 @@ int wt_baton_provide_data(picoquic_cnx_t* cnx,
         int more_to_send = 0;
 
         if (baton_ctx->lanes[lane_id].padding_required == UINT64_MAX) {
-            if (baton_ctx->baton_state == wt_baton_state_done ||
+            if (baton_ctx->message_size != UINT64_MAX) {
+                /* Fixed message size, as set by the "size" parameter */
+                padding_length_length = picoquic_frames_varint_encode_length(baton_ctx->message_size);
+                if (space > padding_length_length) {
+                    baton_ctx->lanes[lane_id].padding_required = baton_ctx->message_size;
+                }
+            }
+            else if (baton_ctx->baton_state == wt_baton_state_done ||
                 baton_ctx->nb_baton_bytes_sent > 0x10000) {
                 baton_ctx->lanes[lane_id].padding_required = 0;
                 padding_length_length = 1;
@@ -500,42 +539,49 @@ int wt_baton_provide_data(picoquic_cnx_t* cnx,
                 padding_length_length = 2;
             }
         }
-        useful = padding_length_length + (size_t)(baton_ctx->lanes[lane_id].padding_required - 
-            baton_ctx->lanes[lane_id].padding_sent) + 1;
-        if (useful > space) {
-            more_to_send = 1;
-            useful = space;
-            pad_length = space - padding_length_length;
+        if (baton_ctx->lanes[lane_id].padding_required == UINT64_MAX) {
+            /* Not enough space for the length of padding, wait for the next call */
+            (void)picoquic_provide_stream_data_buffer(context, 0, 0, 1);
         }
         else {
-            pad_length = (size_t)(baton_ctx->lanes[lane_id].padding_required - baton_ctx->lanes[lane_id].padding_sent);
-        }
-        buffer = picoquic_provide_stream_data_buffer(context, useful, !more_to_send, more_to_send);
-        if (padding_length_length > 0) {
-            (void)picoquic_frames_varint_encode(buffer, buffer + padding_length_length,
-                baton_ctx->lanes[lane_id].padding_required);
-            consumed = padding_length_length;
-        }
-        if (pad_length > 0) {
-            memset(buffer + consumed, 0, pad_length);
-            consumed += pad_length;
-            baton_ctx->lanes[lane_id].padding_sent += pad_length;
-        }
-        baton_ctx->nb_baton_bytes_sent += useful;
-
-        if (baton_ctx->lanes[lane_id].baton_state == wt_baton_state_sending &&
-            !more_to_send) {
-            /* Everything was sent! */
-            buffer[consumed] = baton_ctx->lanes[lane_id].baton;
-            if (IS_BIDIR_STREAM_ID(stream_ctx->stream_id) &&
-                IS_LOCAL_STREAM_ID(stream_ctx->stream_id, baton_ctx->is_client) &&
-                baton_ctx->lanes[lane_id].baton == 0) {
-                baton_ctx->count_fin_wait++;
+            useful = padding_length_length + (size_t)(baton_ctx->lanes[lane_id].padding_required - 
+                baton_ctx->lanes[lane_id].padding_sent) + 1;
+            if (useful > space) {
+                more_to_send = 1;
+                useful = space;
+                pad_length = space - padding_length_length;
+            }
+            else {
+                pad_length = (size_t)(baton_ctx->lanes[lane_id].padding_required - baton_ctx->lanes[lane_id].padding_sent);
             }
-            baton_ctx->lanes[lane_id].baton_state = wt_baton_state_sent;
-            stream_ctx->ps.stream_state.is_fin_sent = 1;
-            if (stream_ctx->ps.stream_state.is_fin_received == 1) {
-                h3zero_delete_stream(cnx, baton_ctx->h3_ctx, stream_ctx);
+            buffer = picoquic_provide_stream_data_buffer(context, useful, !more_to_send, more_to_send);
+            if (padding_length_length > 0) {
+                (void)picoquic_frames_varint_encode(buffer, buffer + padding_length_length,
+                    baton_ctx->lanes[lane_id].padding_required);
+                consumed = padding_length_length;
+            }
+            if (pad_length > 0) {
+                memset(buffer + consumed, 0, pad_length);
+                consumed += pad_length;
+                baton_ctx->lanes[lane_id].padding_sent += pad_length;
+            }
+            baton_ctx->nb_baton_bytes_sent += useful;
+
+            if (baton_ctx->lanes[lane_id].baton_state == wt_baton_state_sending &&
+                !more_to_send) {
+                /* Everything was sent! */
+                buffer[consumed] = baton_ctx->lanes[lane_id].baton;
+                baton_ctx->lanes[lane_id].send_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+                if (IS_BIDIR_STREAM_ID(stream_ctx->stream_id) &&
+                    IS_LOCAL_STREAM_ID(stream_ctx->stream_id, baton_ctx->is_client) &&
+                    baton_ctx->lanes[lane_id].baton == 0) {
+                    baton_ctx->count_fin_wait++;
+                }
+                baton_ctx->lanes[lane_id].baton_state = wt_baton_state_sent;
+                stream_ctx->ps.stream_state.is_fin_sent = 1;
+                if (stream_ctx->ps.stream_state.is_fin_received == 1) {
+                    h3zero_delete_stream(cnx, baton_ctx->h3_ctx, stream_ctx);
+                }
             }
         }
     }
@@ -558,13 +604,19 @@ int wt_baton_ctx_path_params(wt_baton_ctx_t* baton_ctx, const uint8_t* path, siz
         if (h3zero_query_parameter_number(queries, queries_length, "version", 5, &baton_ctx->version, 0) != 0 ||
             h3zero_query_parameter_number(queries, queries_length, "baton", 5, &baton_ctx->initial_baton, 0) != 0 ||
             h3zero_query_parameter_number(queries, queries_length, "count", 5, &baton_ctx->nb_lanes, 1) != 0 ||
-            h3zero_query_parameter_number(queries, queries_length, "inject", 6, &baton_ctx->inject_error, 0) != 0) {
+            h3zero_query_parameter_number(queries, queries_length, "inject", 6, &baton_ctx->inject_error, 0) != 0 ||
+            h3zero_query_parameter_number(queries, queries_length, "size", 4, &baton_ctx->message_size, UINT64_MAX) != 0 ||
+            h3zero_query_parameter_number(queries, queries_length, "dgram", 5, &baton_ctx->datagrams_per_turn, 0) != 0 ||
+            h3zero_query_parameter_number(queries, queries_length, "dsize", 5, &baton_ctx->datagram_size, 0) != 0) {
             ret = -1;
         }
         else if ( baton_ctx->version != WT_BATON_VERSION ||
             baton_ctx->initial_baton > 255 ||
             baton_ctx->nb_lanes > WT_BATON_MAX_LANES||
-            baton_ctx->nb_lanes < 1 ) {
+            baton_ctx->nb_lanes < 1 ||
+            (baton_ctx->message_size != UINT64_MAX && baton_ctx->message_size > WT_BATON_MAX_MESSAGE_SIZE) ||
+            baton_ctx->datagrams_per_turn > WT_BATON_MAX_COUNT ||
+            (baton_ctx->datagram_size != 0 && (baton_ctx->datagram_size < 3 || baton_ctx->datagram_size > WT_BATON_MAX_DATAGRAM_SIZE))) {
             ret = -1;
         }
     }
@@ -633,7 +685,7 @@ int wt_baton_stream_reset(picoquic_cnx_t* cnx, h3zero_stream_ctx_t* stream_ctx,
         /* Any reset results in the abandon of the context */
         baton_ctx->baton_state = wt_baton_state_closed;
         if (baton_ctx->is_client) {
-            ret = picoquic_close(cnx, 0);
+            ret = wt_baton_client_session_closed(cnx, baton_ctx);
         }
         h3zero_delete_stream_prefix(cnx, baton_ctx->h3_ctx, baton_ctx->control_stream_id);
     }
@@ -699,14 +751,29 @@ int wt_baton_provide_datagram(picoquic_cnx_t* cnx,
     wt_baton_ctx_t* baton_ctx = (wt_baton_ctx_t*)path_app_ctx;
 
     if (baton_ctx->is_datagram_ready) {
-        if (space > 1536) {
-            space = 1536;
+        if (space > WT_BATON_MAX_DATAGRAM_SIZE) {
+            space = WT_BATON_MAX_DATAGRAM_SIZE;
+        }
+        if (baton_ctx->datagram_size > 0) {
+            if (space < baton_ctx->datagram_size) {
+                /* Wait for a packet with enough space */
+                space = 0;
+                (void)h3zero_provide_datagram_buffer(context, 0, 1);
+            }
+            else {
+                space = (size_t)baton_ctx->datagram_size;
+            }
         }
         if (space < 3) {
             /* Not enough space to send anything */
         }
         else {
-            uint8_t* buffer = h3zero_provide_datagram_buffer(context, space, 0);
+            uint8_t* buffer;
+
+            if (baton_ctx->nb_datagrams_pending > 0) {
+                baton_ctx->nb_datagrams_pending--;
+            }
+            buffer = h3zero_provide_datagram_buffer(context, space, baton_ctx->nb_datagrams_pending > 0);
             if (buffer == NULL) {
                 ret = -1;
             }
@@ -718,8 +785,10 @@ int wt_baton_provide_datagram(picoquic_cnx_t* cnx,
                 memset(bytes, 0, padding_length);
                 bytes += padding_length;
                 *bytes = baton_ctx->baton_datagram_send_next;
-                baton_ctx->is_datagram_ready = 0;
-                baton_ctx->baton_datagram_send_next = 0;
+                if (baton_ctx->nb_datagrams_pending == 0) {
+                    baton_ctx->is_datagram_ready = 0;
+                    baton_ctx->baton_datagram_send_next = 0;
+                }
                 baton_ctx->nb_datagrams_sent += 1;
                 baton_ctx->nb_datagram_bytes_sent += space;
             }
@@ -770,6 +839,12 @@ int wt_baton_callback(picoquic_cnx_t* cnx,
         if (stream_ctx != NULL) {
             stream_ctx->is_upgraded = 1;
         }
+        if (path_app_ctx != NULL) {
+            wt_baton_bench_t* bench = ((wt_baton_ctx_t*)path_app_ctx)->bench;
+            if (bench != NULL && bench->start_time == 0) {
+                bench->start_time = picoquic_get_quic_time(picoquic_get_quic_ctx(cnx));
+            }
+        }
         break;
 
     case picohttp_callback_post_fin:
@@ -830,6 +905,7 @@ int wt_baton_ctx_init(wt_baton_ctx_t* baton_ctx, h3zero_callback_ctx_t* h3_ctx,
     int ret = 0;
 
     memset(baton_ctx, 0, sizeof(wt_baton_ctx_t));
+    baton_ctx->message_size = UINT64_MAX;
     /* Init the stream tree */
     /* Do we use the path table for the client? or the web folder? */
     /* connection wide tracking of stream prefixes */
@@ -925,3 +1001,107 @@ int wt_baton_prepare_context(picoquic_cnx_t* cnx, wt_baton_ctx_t* baton_ctx,
 
     return ret;
 }
+
+/* Benchmark mode.
+ * All sessions share the same connection and the same latency histogram.
+ */
+wt_baton_bench_t* wt_baton_bench_create(size_t nb_sessions)
+{
+    wt_baton_bench_t* bench = NULL;
+
+    if (nb_sessions > 0 && (bench = (wt_baton_bench_t*)malloc(sizeof(wt_baton_bench_t))) != NULL) {
+        memset(bench, 0, sizeof(wt_baton_bench_t));
+        bench->sessions = (wt_baton_ctx_t*)malloc(nb_sessions * sizeof(wt_baton_ctx_t));
+        if (bench->sessions == NULL) {
+            free(bench);
+            bench = NULL;
+        }
+        else {
+            memset(bench->sessions, 0, nb_sessions * sizeof(wt_baton_ctx_t));
+            bench->nb_sessions = nb_sessions;
+        }
+    }
+    return bench;
+}
+
+void wt_baton_bench_delete(wt_baton_bench_t* bench)
+{
+    if (bench != NULL) {
+        if (bench->sessions != NULL) {
+            free(bench->sessions);
+        }
+        free(bench);
+    }
+}
+
+int wt_baton_bench_connect(picoquic_cnx_t* cnx, wt_baton_bench_t* bench,
+    h3zero_callback_ctx_t* h3_ctx, h3zero_stream_ctx_t* control_stream_ctx,
+    const char* server_name, const char* path)
+{
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < bench->nb_sessions; i++) {
+        wt_baton_ctx_t* baton_ctx = &bench->sessions[i];
+
+        if (i > 0 && (control_stream_ctx = picowt_set_control_stream(cnx, h3_ctx)) == NULL) {
+            ret = -1;
+        }
+        else if ((ret = wt_baton_prepare_context(cnx, baton_ctx, h3_ctx, control_stream_ctx,
+            server_name, path)) == 0) {
+            baton_ctx->bench = bench;
+            ret = picowt_connect(cnx, h3_ctx, control_stream_ctx, baton_ctx->authority, baton_ctx->server_path,
+                wt_baton_callback, baton_ctx);
+        }
+    }
+    return ret;
+}
+
+int wt_baton_bench_report(FILE* F, const wt_baton_bench_t* bench, uint64_t current_time)
+{
+    int ret = 0;
+    uint64_t nb_sent = 0;
+    uint64_t nb_received = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    uint64_t nb_datagrams_sent = 0;
+    uint64_t nb_datagrams_received = 0;
+    uint64_t datagram_bytes_sent = 0;
+    uint64_t datagram_bytes_received = 0;
+    uint64_t end_time = (bench->end_time > 0) ? bench->end_time : current_time;
+    uint64_t duration = (end_time > bench->start_time) ? end_time - bench->start_time : 0;
+    double seconds = (double)duration / 1000000.0;
+
+    for (size_t i = 0; i < bench->nb_sessions; i++) {
+        const wt_baton_ctx_t* baton_ctx = &bench->sessions[i];
+        nb_sent += baton_ctx->nb_turns;
+        nb_received += baton_ctx->nb_batons_received;
+        bytes_sent += baton_ctx->nb_baton_bytes_sent;
+        bytes_received += baton_ctx->nb_baton_bytes_received;
+        nb_datagrams_sent += baton_ctx->nb_datagrams_sent;
+        nb_datagrams_received += baton_ctx->nb_datagrams_received;
+        datagram_bytes_sent += baton_ctx->nb_datagram_bytes_sent;
+        datagram_bytes_received += baton_ctx->nb_datagram_bytes_received;
+    }
+
+    ret |= fprintf(F, "Baton benchmark: %zu sessions, %zu closed, %.3f seconds.\n",
+        bench->nb_sessions, bench->nb_sessions_closed, seconds) <= 0;
+    ret |= fprintf(F, "Messages sent/received: %" PRIu64 "/ %" PRIu64 ", bytes sent/received: %" PRIu64 "/ %" PRIu64 "\n",
+        nb_sent, nb_received, bytes_sent, bytes_received) <= 0;
+    ret |= fprintf(F, "Datagrams sent/received: %" PRIu64 "/ %" PRIu64 ", bytes sent/received: %" PRIu64 "/ %" PRIu64 "\n",
+        nb_datagrams_sent, nb_datagrams_received, datagram_bytes_sent, datagram_bytes_received) <= 0;
+    if (duration > 0) {
+        ret |= fprintf(F, "Messages/s: %.1f, bytes/s: %.0f, datagrams/s: %.1f, datagram bytes/s: %.0f\n",
+            (double)(nb_sent + nb_received) / seconds, (double)(bytes_sent + bytes_received) / seconds,
+            (double)(nb_datagrams_sent + nb_datagrams_received) / seconds,
+            (double)(datagram_bytes_sent + datagram_bytes_received) / seconds) <= 0;
+    }
+    if (bench->latency.count > 0) {
+        ret |= fprintf(F, "Message latency (us), count %" PRIu64 ", min/average/max = %" PRIu64 "/ %" PRIu64 "/ %" PRIu64,
+            bench->latency.count, bench->latency.min, bench->latency.sum / bench->latency.count, bench->latency.max) <= 0;
+        ret |= fprintf(F, ", p50/p90/p99/p99.9 = %" PRIu64 "/ %" PRIu64 "/ %" PRIu64 "/ %" PRIu64 "\n",
+            quicperf_histogram_percentile(&bench->latency, 50), quicperf_histogram_percentile(&bench->latency, 90),
+            quicperf_histogram_percentile(&bench->latency, 99), quicperf_histogram_percentile(&bench->latency, 99.9)) <= 0;
+    }
+
+    return ret;
+}
@@ -30,9 +30,12 @@
 #ifndef WT_BATON_H
 #define WT_BATON_H
 
+#include <stdio.h>
 #include "h3zero.h"
 #include "h3zero_common.h"
 #include "pico_webtransport.h"
+#include "picosplay.h"
+#include "quicperf.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,6 +53,8 @@ extern "C" {
 #define WT_BATON_VERSION 0
 #define WT_BATON_MAX_COUNT 256
 #define WT_BATON_MAX_LANES 256
+#define WT_BATON_MAX_MESSAGE_SIZE 0x3FFFFFFF
+#define WT_BATON_MAX_DATAGRAM_SIZE 1536
 
     /* Wt_baton context:
      *
@@ -75,6 +80,7 @@ extern "C" {
         uint64_t sending_stream_id; /* UINT64_MAX if unknown */
         uint64_t padding_required;  /* UINT64_MAX if unknown */
         uint64_t padding_sent;
+        uint64_t send_time; /* time at which the last baton was sent */
     } wt_baton_lane_t;
 
     typedef struct st_wt_baton_incoming_t {
@@ -87,6 +93,8 @@ extern "C" {
         uint8_t baton_received;
     } wt_baton_incoming_t;
 
+    struct st_wt_baton_bench_t;
+
     typedef struct st_wt_baton_ctx_t {
         picoquic_cnx_t* cnx;
         h3zero_callback_ctx_t* h3_ctx;
@@ -107,7 +115,11 @@ extern "C" {
         uint64_t lanes_completed;
         uint64_t count_fin_wait;
         uint64_t inject_error;
+        uint64_t message_size; /* padding per baton message, UINT64_MAX if not set */
+        uint64_t datagrams_per_turn; /* if 0, send datagrams per the baton protocol */
+        uint64_t datagram_size; /* if 0, fill the available space */
         int nb_turns;
+        uint64_t nb_batons_received;
         wt_baton_state_enum baton_state;
         wt_baton_lane_t lanes[256];
         wt_baton_incoming_t incoming[256];
@@ -118,9 +130,13 @@ extern "C" {
         int nb_datagrams_sent;
         size_t nb_datagram_bytes_sent;
         int is_datagram_ready;
+        uint64_t nb_datagrams_pending;
         uint8_t baton_datagram_send_next;
         uint64_t nb_baton_bytes_received;
         uint64_t nb_baton_bytes_sent;
+        /* Benchmark, client only */
+        struct st_wt_baton_bench_t* bench;
+        int is_bench_closed;
     } wt_baton_ctx_t;
 
     typedef struct st_wt_baton_app_ctx_t {
@@ -142,6 +158,36 @@ extern "C" {
     h3zero_stream_ctx_t* wt_baton_find_stream(wt_baton_ctx_t* ctx, uint64_t stream_id);
 
     int wt_baton_ctx_init(wt_baton_ctx_t* baton_ctx, h3zero_callback_ctx_t* h3_ctx, wt_baton_app_ctx_t* app_ctx, h3zero_stream_ctx_t* stream_ctx);
+
+    /* Benchmark mode.
+     * The client runs nb_sessions baton sessions in parallel over the same
+     * connection, all using the same path. The path parameters set the
+     * number of lanes per session (count), the padding of each baton
+     * message (size), the number of datagrams sent per turn (dgram) and
+     * their size (dsize). The latency of a message is measured from the
+     * time a baton is sent on a lane to the time the incremented baton
+     * comes back on that lane, in microseconds.
+     * The connection is closed when all sessions are closed.
+     */
+    typedef struct st_wt_baton_bench_t {
+        size_t nb_sessions;
+        size_t nb_sessions_closed;
+        wt_baton_ctx_t* sessions;
+        uint64_t start_time;
+        uint64_t end_time;
+        quicperf_histogram_t latency;
+    } wt_baton_bench_t;
+
+    wt_baton_bench_t* wt_baton_bench_create(size_t nb_sessions);
+    void wt_baton_bench_delete(wt_baton_bench_t* bench);
+    /* Prepare and connect all the sessions. The control stream created by
+     * picowt_prepare_client_cnx is used for the first session. */
+    int wt_baton_bench_connect(picoquic_cnx_t* cnx, wt_baton_bench_t* bench,
+        h3zero_callback_ctx_t* h3_ctx, h3zero_stream_ctx_t* control_stream_ctx,
+        const char* server_name, const char* path);
+    /* Print rates and latency percentiles. If the sessions are
+     * not all closed, the current time is used as end of test. */
+    int wt_baton_bench_report(FILE* F, const wt_baton_bench_t* bench, uint64_t current_time);
     
     /* Web transport callback. This will be called from the web server
     * when the path points to a web transport callback
@@ -50,16 +50,26 @@ static const picoquic_test_def_t test_table[] = {
     { "h3zero_incoming_unidir", h3zero_incoming_unidir_test },
     { "h3zero_unidir_error", h3zero_unidir_error_test },
     { "h3zero_setting_error", h3zero_setting_error_test },
+    { "h3zero_priority", h3zero_priority_test },
     { "h3zero_capsule", h3zero_capsule_test },
+    { "h3zero_capsule_parse", h3zero_capsule_parse_test },
     { "h3zero_client_data", h3zero_client_data_test },
     { "qpack_huffman", qpack_huffman_test },
     { "qpack_huffman_base", qpack_huffman_base_test},
+    { "qpack_huffman_encode", qpack_huffman_encode_test },
+    { "qpack_huffman_bench", qpack_huffman_bench_test },
     { "h3zero_parse_qpack", h3zero_parse_qpack_test },
+    { "h3zero_parse_qpack_borrowed", h3zero_parse_qpack_borrowed_test },
     { "h3zero_prepare_qpack", h3zero_prepare_qpack_test },
     { "h3zero_user_agent", h3zero_user_agent_test },
     { "h3zero_uri", h3zero_uri_test },
     { "h3zero_null_sni", h3zero_null_sni_test },
     { "h3zero_qpack_fuzz", h3zero_qpack_fuzz_test },
+    { "h3zero_qpack_dynamic", h3zero_qpack_dynamic_test },
+    { "h3zero_qpack_blocked", h3zero_qpack_blocked_test },
+    { "h3zero_qpack_no_block", h3zero_qpack_no_block_test },
+    { "h3zero_qpack_eviction", h3zero_qpack_eviction_test },
+    { "h3zero_qpack_error", h3zero_qpack_error_test },
     { "h3zero_stream_test", h3zero_stream_test },
     { "h3zero_stream_fuzz", h3zero_stream_fuzz_test },
     { "parse_demo_scenario", parse_demo_scenario_test },
@@ -69,12 +79,24 @@ static const picoquic_test_def_t test_table[] = {
     { "generic_server", generic_server_test },
     { "h3zero_post", h3zero_post_test },
     { "h09_post", h09_post_test },
+    { "h3zero_post_backpressure", h3zero_post_backpressure_test },
+    { "demo_pipeline", demo_pipeline_test },
     { "demo_alpn", demo_alpn_test },
     { "demo_ticket", demo_ticket_test },
     { "demo_error", demo_error_test },
     { "demo_file_sanitize", demo_file_sanitize_test },
     { "demo_file_access", demo_file_access_test },
+    { "demo_file_encoding", demo_file_encoding_test },
     { "demo_server_file", demo_server_file_test },
+    { "h3zero_file_cache", h3zero_file_cache_test },
+    { "h3zero_file_cache_serve", h3zero_file_cache_serve_test },
+    { "h3zero_response_cache", h3zero_response_cache_test },
+    { "h3zero_response_cache_serve", h3zero_response_cache_serve_test },
+    { "h3zero_path_router", h3zero_path_router_test },
+    { "h3zero_stream_index", h3zero_stream_index_test },
+    { "h3zero_datagram_queue", h3zero_datagram_queue_test },
+    { "h3zero_cnx_pool", h3zero_cnx_pool_test },
+    { "connect_udp", connect_udp_test },
     { "h3zero_satellite", h3zero_satellite_test },
     { "h09_satellite", h09_satellite_test },
     { "h09_lone_fin", h09_lone_fin_test },
@@ -98,6 +120,7 @@ static const picoquic_test_def_t test_table[] = {
     { "picowt_baton_long", picowt_baton_long_test },
     { "picowt_baton_multi", picowt_baton_multi_test },
     { "picowt_baton_random", picowt_baton_random_test },
+    { "picowt_baton_bench", picowt_baton_bench_test },
     { "picowt_baton_uri", picowt_baton_uri_test },
     { "picowt_baton_wrong", picowt_baton_wrong_test },
     { "picowt_drain", picowt_drain_test },
@@ -108,6 +131,8 @@ static const picoquic_test_def_t test_table[] = {
     { "quicperf_media", quicperf_media_test },
     { "quicperf_multi", quicperf_multi_test },
     { "quicperf_overflow", quicperf_overflow_test },
+    { "quicperf_load", quicperf_load_test },
+    { "quicperf_histogram", quicperf_histogram_test },
     { "cc_compete_cubic2", cc_compete_cubic2_test },
     { "cc_compete_prague2", cc_compete_prague2_test },
     { "cc_compete_d_cubic", cc_compete_d_cubic_test },
@@ -121,7 +146,9 @@ static const picoquic_test_def_t test_table[] = {
     { "cc_ns_wifi_bad_bbr", cc_ns_wifi_bad_bbr_test },
     { "cc_ns_varylink", cc_ns_varylink_test },
     { "cc_ns_satellite", cc_ns_satellite_test },
-    { "cc_ns_media", cc_ns_media_test }
+    { "cc_ns_media", cc_ns_media_test },
+    { "cc_ns_sweep", cc_ns_sweep_test },
+    { "cc_ns_cpu_cost", cc_ns_cpu_cost_test }
 };
 
 static size_t const nb_tests = sizeof(test_table) / sizeof(picoquic_test_def_t);
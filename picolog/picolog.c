@@ -27,10 +27,12 @@
 #include "picoquic_internal.h"
 #include "bytestream.h"
 #include "csv.h"
+#include "cc_arrow.h"
 #include "svg.h"
 #include "qlog.h"
 #include "cidset.h"
 #include "logreader.h"
+#include "cc_replay.h"
 #ifdef _WINDOWS
 #include "../picoquicfirst/getopt.h"
 #endif
@@ -42,18 +44,28 @@ typedef struct app_conversion_context_st
 
     const char * binlog_name;
     FILE * f_binlog;
+    binlog_index_t * index;
 
     const char * template_name;
     FILE * f_template;
 
+    const char * cc_algo_id;
+    const char * cc_algo_option;
+    picoquic_congestion_algorithm_t const * cc_algo;
+
     uint64_t log_time;
     uint16_t flags;
+    int nb_threads;
 } app_conversion_context_t;
 
 int convert_csv(const picoquic_connection_id_t * cid, void * ptr);
+int convert_arrow(const picoquic_connection_id_t* cid, void* ptr);
 int convert_svg(const picoquic_connection_id_t * cid, void * ptr);
 int convert_qlog(const picoquic_connection_id_t * cid, void * ptr);
+int convert_replay(const picoquic_connection_id_t* cid, void* ptr);
 int filedump_binlog(FILE* bin_log, FILE* bin_dump);
+int convert_indexed(app_conversion_context_t* appctx, picohash_table* cids,
+    int (*convert_fn)(const picoquic_connection_id_t*, void*));
 
 int usage();
 void usage_formats();
@@ -81,9 +93,10 @@ int main(int argc, char ** argv)
 
     app_conversion_context_t appctx = { 0 };
     appctx.out_format = "csv";
+    appctx.nb_threads = 1;
 
     int opt;
-    while ((opt = getopt(argc, argv, "o:f:t:c:h")) != -1) {
+    while ((opt = getopt(argc, argv, "o:f:t:c:a:p:j:h")) != -1) {
         switch (opt) {
         case 'o':
             appctx.out_dir = optarg;
@@ -97,6 +110,19 @@ int main(int argc, char ** argv)
         case 'c':
             cid_name = optarg;
             break;
+        case 'a':
+            appctx.cc_algo_id = optarg;
+            break;
+        case 'p':
+            appctx.cc_algo_option = optarg;
+            break;
+        case 'j':
+            appctx.nb_threads = atoi(optarg);
+            if (appctx.nb_threads < 1) {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                return usage();
+            }
+            break;
         case 'h':
         default:
             return usage();
@@ -156,8 +182,26 @@ int main(int argc, char ** argv)
                 }
             }
 
-            if (ret == 0) {
+            if (ret == 0 && strcmp(appctx.out_format, "replay") != 0) {
+                /* Map the file and index the events of each connection. The CSV, SVG
+                 * and QLOG conversions then read only the events of their connection,
+                 * and can run in parallel. */
+                appctx.index = binlog_index_open(appctx.binlog_name, &appctx.flags, &appctx.log_time);
+                if (appctx.index == NULL) {
+                    fprintf(stderr, "Could not index log file %s\n", appctx.binlog_name);
+                    ret = -1;
+                }
+                else {
+                    for (size_t i = 0; i < binlog_index_nb_cids(appctx.index); i++) {
+                        cidset_insert(cids, binlog_index_cid(appctx.index, i));
+                    }
+                }
+            }
+            else if (ret == 0) {
                 binlog_list_cids(appctx.f_binlog, cids);
+            }
+
+            if (ret == 0) {
 
                 fprintf(stderr, "%s contains %"PRIst" connection(s):\n\n", appctx.binlog_name, cids->count);
                 cidset_print(stderr, cids);
@@ -183,7 +227,10 @@ int main(int argc, char ** argv)
 
             if (ret == 0) {
                 if (strcmp(appctx.out_format, "csv") == 0) {
-                    ret = cidset_iterate(cids, convert_csv, &appctx);
+                    ret = convert_indexed(&appctx, cids, convert_csv);
+                }
+                else if (strcmp(appctx.out_format, "arrow") == 0) {
+                    ret = convert_indexed(&appctx, cids, convert_arrow);
                 }
                 else if (strcmp(appctx.out_format, "svg") == 0) {
                     if (appctx.f_template == NULL) {
@@ -191,11 +238,22 @@ int main(int argc, char ** argv)
                         ret = -1;
                     }
                     else {
-                        ret = cidset_iterate(cids, convert_svg, &appctx);
+                        ret = convert_indexed(&appctx, cids, convert_svg);
                     }
                 }
                 else if (strcmp(appctx.out_format, "qlog") == 0) {
-                    ret = cidset_iterate(cids, convert_qlog, &appctx);
+                    ret = convert_indexed(&appctx, cids, convert_qlog);
+                }
+                else if (strcmp(appctx.out_format, "replay") == 0) {
+                    picoquic_register_all_congestion_control_algorithms();
+                    appctx.cc_algo = picoquic_get_congestion_algorithm(appctx.cc_algo_id);
+                    if (appctx.cc_algo == NULL) {
+                        fprintf(stderr, "The replay format requires a valid congestion algorithm specified by parameter -a\n");
+                        ret = -1;
+                    }
+                    else {
+                        ret = cidset_iterate(cids, convert_replay, &appctx);
+                    }
                 }
                 else {
                     fprintf(stderr, "Invalid output format '%s'. Valid formats are\n\n", appctx.out_format);
@@ -206,6 +264,7 @@ int main(int argc, char ** argv)
         }
     }
 
+    binlog_index_close(appctx.index);
     (void)picoquic_file_close(appctx.f_binlog);
     (void)picoquic_file_close(appctx.f_template);
     (void)cidset_delete(cids);
@@ -224,6 +283,10 @@ int usage()
     usage_formats();
     fprintf(stderr, "  -t template-file      template file for svg format conversion\n");
     fprintf(stderr, "  -c connection-id      only convert logs of specified connection id\n");
+    fprintf(stderr, "  -a algorithm          congestion control algorithm for the replay format\n");
+    fprintf(stderr, "  -p option             option string passed to the replayed algorithm\n");
+    fprintf(stderr, "  -j threads            number of connections converted in parallel,\n");
+    fprintf(stderr, "                        requires an output directory, default is 1\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "picolog converts binary log files into the format specified. Output files are\n");
     fprintf(stderr, "placed in the specified directory with their connection-id as file name.\n");
@@ -237,9 +300,33 @@ int usage()
 void usage_formats()
 {
     fprintf(stderr, "                        -f csv  : generate CC csv file\n");
+    fprintf(stderr, "                        -f arrow : generate CC Arrow IPC file, with\n");
+    fprintf(stderr, "                                  the columns of the csv file\n");
     fprintf(stderr, "                        -f svg  : generate svg packet flow diagram.\n");
     fprintf(stderr, "                                  requires a template specified by -t\n");
     fprintf(stderr, "                        -f qlog : generate IETF QLOG file\n");
+    fprintf(stderr, "                        -f replay : replay the ACKs and losses through the\n");
+    fprintf(stderr, "                                  algorithm specified by -a, generate csv\n");
+}
+
+/* Convert either the single connection selected with -c, or all the
+ * connections in the index, using the requested number of threads.
+ * Conversions write to stdout if no output directory is specified,
+ * and are then kept sequential. */
+int convert_indexed(app_conversion_context_t* appctx, picohash_table* cids,
+    int (*convert_fn)(const picoquic_connection_id_t*, void*))
+{
+    int ret = 0;
+
+    if (cids->count < binlog_index_nb_cids(appctx->index)) {
+        ret = cidset_iterate(cids, convert_fn, appctx);
+    }
+    else {
+        ret = binlog_index_iterate(appctx->index, (appctx->out_dir == NULL) ? 1 : appctx->nb_threads,
+            convert_fn, appctx);
+    }
+
+    return ret;
 }
 
 int convert_csv(const picoquic_connection_id_t * cid, void * ptr)
@@ -254,8 +341,50 @@ int convert_csv(const picoquic_connection_id_t * cid, void * ptr)
     }
 
     if (ret == 0) {
-        ret = picoquic_cc_bin_to_csv(appctx->f_binlog,
-            open_outfile(cid_name, appctx->binlog_name, appctx->out_dir, "csv"));
+        FILE* f_csvlog = open_outfile(cid_name, appctx->binlog_name, appctx->out_dir, "csv");
+
+        if (f_csvlog == NULL) {
+            ret = -1;
+        }
+        else {
+            ret = picoquic_cc_bin_to_csv_indexed(appctx->index, cid, f_csvlog);
+            if (f_csvlog != stdout) {
+                (void)picoquic_file_close(f_csvlog);
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* The Arrow files are binary, so they are never written to stdout */
+int convert_arrow(const picoquic_connection_id_t* cid, void* ptr)
+{
+    const app_conversion_context_t* appctx = (const app_conversion_context_t*)ptr;
+    int ret = 0;
+    char cid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
+    char filename[512];
+
+    if (picoquic_print_connection_id_hexa(cid_name, sizeof(cid_name), cid) != 0) {
+        DBG_PRINTF("Cannot convert connection id for %s", appctx->binlog_name);
+        ret = -1;
+    }
+    else if (picoquic_sprintf(filename, sizeof(filename), NULL, "%s%s%s.arrow",
+        (appctx->out_dir == NULL) ? "." : appctx->out_dir, PICOQUIC_FILE_SEPARATOR, cid_name) != 0) {
+        DBG_PRINTF("Cannot format file name for connection %s in file %s", cid_name, appctx->binlog_name);
+        ret = -1;
+    }
+    else {
+        FILE* f_arrow = picoquic_file_open(filename, "wb");
+
+        if (f_arrow == NULL) {
+            fprintf(stderr, "Could not open '%s' for writing (err=%d)", filename, errno);
+            ret = -1;
+        }
+        else {
+            ret = picoquic_cc_bin_to_arrow_indexed(appctx->index, cid, f_arrow);
+            (void)picoquic_file_close(f_arrow);
+        }
     }
 
     return ret;
@@ -264,61 +393,99 @@ int convert_csv(const picoquic_connection_id_t * cid, void * ptr)
 int convert_svg(const picoquic_connection_id_t * cid, void * ptr)
 {
     const app_conversion_context_t* appctx = (const app_conversion_context_t*)ptr;
-    return svg_convert(cid, appctx->f_binlog, appctx->f_template, appctx->binlog_name, appctx->out_dir);
+    /* Each conversion reads the template from the start, with its own file handle */
+    FILE* f_template = picoquic_file_open(appctx->template_name, "r");
+    int ret = 0;
+
+    if (f_template == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = svg_convert_indexed(cid, appctx->index, f_template, appctx->binlog_name, appctx->out_dir);
+        (void)picoquic_file_close(f_template);
+    }
+
+    return ret;
 }
 
 int convert_qlog(const picoquic_connection_id_t * cid, void * ptr)
 {
     const app_conversion_context_t* appctx = (const app_conversion_context_t*)ptr;
-    return qlog_convert(cid, appctx->f_binlog, appctx->binlog_name, NULL, appctx->out_dir, appctx->flags);
+    return qlog_convert_indexed(cid, appctx->index, appctx->binlog_name, NULL, appctx->out_dir, appctx->flags);
 }
 
-int filedump_binlog(FILE* bin_log, FILE* bin_dump)
+int convert_replay(const picoquic_connection_id_t* cid, void* ptr)
 {
+    const app_conversion_context_t* appctx = (const app_conversion_context_t*)ptr;
     int ret = 0;
-    uint8_t head[4];
-    bytestream_buf stream_msg;
-
-    fseek(bin_log, 16, SEEK_SET);
-
-    fprintf(bin_dump, "MSG-len, I-CID, Time, ID, Comment\n");
+    FILE* f_csv = NULL;
+    picoquic_cc_replay_stats_t stats = { 0 };
 
-    while (ret == 0 && fread(head, sizeof(head), 1, bin_log) > 0) {
+    char cid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
+    if (picoquic_print_connection_id_hexa(cid_name, sizeof(cid_name), cid) != 0) {
+        DBG_PRINTF("Cannot convert connection id for %s", appctx->binlog_name);
+        ret = -1;
+    }
 
-        uint32_t len = (head[0] << 24) | (head[1] << 16) | (head[2] << 8) | head[3];
-        if (len > sizeof(stream_msg.buf)) {
-            fprintf(bin_dump, "%d, x, 0, 0, \"Message larger than buffer[%d]\"\n", len, (int)sizeof(stream_msg.buf));
+    if (ret == 0) {
+        if ((f_csv = open_outfile(cid_name, appctx->binlog_name, appctx->out_dir, "replay.csv")) == NULL) {
             ret = -1;
         }
-
-        if (ret == 0 && fread(stream_msg.buf, len, 1, bin_log) <= 0) {
-            fprintf(bin_dump, "%d, x, 0, 0, \"Message cannot be read from file\n", len);
-            ret = -1;
+        else {
+            ret = picoquic_cc_replay(appctx->f_binlog, cid, appctx->cc_algo, appctx->cc_algo_option, f_csv, &stats);
+            if (f_csv != stdout) {
+                (void)picoquic_file_close(f_csv);
+            }
         }
+    }
 
-        if (ret == 0) {
-            bytestream* s = bytestream_buf_init(&stream_msg, len);
+    if (ret == 0) {
+        fprintf(stderr, "%s: %" PRIu64 " acks, %" PRIu64 " losses, cwin max %" PRIu64 "\n",
+            cid_name, stats.nb_acks, stats.nb_losses, stats.cwin_max);
+    }
 
-            picoquic_connection_id_t cid;
-            ret |= byteread_cid(s, &cid);
+    return ret;
+}
 
-            uint64_t time = 0;
-            ret |= byteread_vint(s, &time);
+static int filedump_chunk(bytestream* s, void* ptr)
+{
+    FILE* bin_dump = (FILE*)ptr;
+    size_t len = bytestream_size(s);
+    int ret = 0;
 
-            uint64_t id = 0;
-            ret |= byteread_vint(s, &id);
+    picoquic_connection_id_t cid;
+    ret |= byteread_cid(s, &cid);
 
-            if (ret != 0) {
-                fprintf(bin_dump, "%d, x, 0, 0, \"cannot read CID, Time and ID\n", len);
-            }
-            else {
-                fprintf(bin_dump, "%d, x", len);
-                for (uint8_t x = 0; x < cid.id_len; x++) {
-                    fprintf(bin_dump, "%02x", cid.id[x]);
-                }
-                fprintf(bin_dump, ", %" PRIu64 ", %" PRIu64 ",\n", time, id);
-            }
+    uint64_t time = 0;
+    ret |= byteread_vint(s, &time);
+
+    uint64_t id = 0;
+    ret |= byteread_vint(s, &id);
+
+    if (ret != 0) {
+        fprintf(bin_dump, "%d, x, 0, 0, \"cannot read CID, Time and ID\n", (int)len);
+    }
+    else {
+        fprintf(bin_dump, "%d, x", (int)len);
+        for (uint8_t x = 0; x < cid.id_len; x++) {
+            fprintf(bin_dump, "%02x", cid.id[x]);
         }
+        fprintf(bin_dump, ", %" PRIu64 ", %" PRIu64 ",\n", time, id);
+    }
+
+    return ret;
+}
+
+/* Dump the chunks of the file, in either the uncompressed or the block format */
+int filedump_binlog(FILE* bin_log, FILE* bin_dump)
+{
+    int ret = 0;
+
+    fprintf(bin_dump, "MSG-len, I-CID, Time, ID, Comment\n");
+
+    ret = fileread_binlog(bin_log, filedump_chunk, bin_dump);
+    if (ret != 0) {
+        fprintf(bin_dump, "x, x, 0, 0, \"Message cannot be read from file\"\n");
     }
 
     return ret;
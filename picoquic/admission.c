@@ -0,0 +1,306 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Admission control of new connections.
+*
+* Under overload, the cost of a server is dominated by the handshakes of new
+* connections, mostly the certificate signature. The admission controller
+* limits the rate at which Initial packets are allowed to create connections,
+* using a token bucket of "handshakes per second". Packets that arrive when
+* the bucket is empty are copied in a bounded queue, with two classes:
+* packets carrying a token that passed the stateless check, i.e. clients
+* that went through a Retry or that resume with a NEW_TOKEN token, and the
+* other packets. The queue is served in class order, oldest first within a
+* class, when budget becomes available.
+*
+* Packets that cannot be queued, or that waited longer than the maximum
+* queue delay, are dropped silently. The client repeats its Initial after a
+* timer, by which time the overload may have cleared; a CONNECTION_CLOSE
+* with SERVER_BUSY would have turned it away for good. Packets for existing
+* connections never enter the queue, so established connections keep their
+* latency while the server sheds new handshakes.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+int picoquic_set_admission_control(picoquic_quic_t* quic, size_t max_queued,
+    uint64_t handshakes_per_second, uint64_t burst, uint64_t max_queue_delay)
+{
+    int ret = 0;
+
+    if (handshakes_per_second == 0) {
+        picoquic_admission_free(quic);
+    }
+    else {
+        if (quic->admission == NULL) {
+            quic->admission = (picoquic_admission_ctx_t*)malloc(sizeof(picoquic_admission_ctx_t));
+            if (quic->admission != NULL) {
+                memset(quic->admission, 0, sizeof(picoquic_admission_ctx_t));
+            }
+        }
+        if (quic->admission == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            picoquic_admission_ctx_t* admission = quic->admission;
+
+            admission->max_queued = max_queued;
+            admission->handshakes_per_second = handshakes_per_second;
+            admission->burst = (burst == 0) ? 1 : burst;
+            admission->max_queue_delay = max_queue_delay;
+            if (admission->last_time == 0) {
+                admission->credit = admission->burst * 1000000ull;
+            }
+            /* Apply the new queue size right away */
+            while (admission->nb_queued > admission->max_queued) {
+                int queue_class = (admission->first[1] != NULL) ? 1 : 0;
+                picoquic_admission_entry_t* entry = admission->first[queue_class];
+
+                admission->first[queue_class] = entry->next;
+                if (entry->next == NULL) {
+                    admission->last[queue_class] = NULL;
+                }
+                admission->nb_queued--;
+                admission->stats.nb_shed_queue_full++;
+                free(entry);
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_get_admission_stats(picoquic_quic_t* quic, picoquic_admission_stats_t* stats)
+{
+    if (quic->admission == NULL) {
+        memset(stats, 0, sizeof(picoquic_admission_stats_t));
+    }
+    else {
+        *stats = quic->admission->stats;
+        stats->queue_depth = quic->admission->nb_queued;
+    }
+}
+
+void picoquic_admission_free(picoquic_quic_t* quic)
+{
+    if (quic->admission != NULL) {
+        for (int queue_class = 0; queue_class < 2; queue_class++) {
+            while (quic->admission->first[queue_class] != NULL) {
+                picoquic_admission_entry_t* entry = quic->admission->first[queue_class];
+                quic->admission->first[queue_class] = entry->next;
+                free(entry);
+            }
+        }
+        free(quic->admission);
+        quic->admission = NULL;
+    }
+}
+
+static void picoquic_admission_refill(picoquic_admission_ctx_t* admission, uint64_t current_time)
+{
+    uint64_t credit_max = admission->burst * 1000000ull;
+
+    if (current_time > admission->last_time) {
+        uint64_t delta_t = current_time - admission->last_time;
+
+        if (admission->last_time == 0 || delta_t >= credit_max / admission->handshakes_per_second) {
+            admission->credit = credit_max;
+        }
+        else {
+            admission->credit += delta_t * admission->handshakes_per_second;
+            if (admission->credit > credit_max) {
+                admission->credit = credit_max;
+            }
+        }
+        admission->last_time = current_time;
+    }
+}
+
+/* Called when screening an Initial packet that would create a connection.
+ * Returns 0 if the connection can be created now, PICOQUIC_ERROR_INITIAL_QUEUED
+ * if the packet shall be passed to picoquic_admission_queue.
+ */
+int picoquic_admission_check(picoquic_quic_t* quic, int is_priority, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_admission_ctx_t* admission = quic->admission;
+
+    if (admission != NULL && !admission->is_processing) {
+        picoquic_admission_refill(admission, current_time);
+        if (admission->nb_queued == 0 && admission->credit >= 1000000ull) {
+            admission->credit -= 1000000ull;
+            if (is_priority) {
+                admission->stats.nb_admitted_priority++;
+            }
+            else {
+                admission->stats.nb_admitted++;
+            }
+        }
+        else {
+            admission->is_pending_priority = is_priority;
+            ret = PICOQUIC_ERROR_INITIAL_QUEUED;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_admission_is_replay(picoquic_quic_t* quic)
+{
+    return (quic->admission != NULL && quic->admission->is_processing);
+}
+
+/* Copy the datagram that starts with the deferred Initial packet in the queue,
+ * in the class found by the last call to picoquic_admission_check.
+ */
+void picoquic_admission_queue(picoquic_quic_t* quic, const uint8_t* bytes, size_t length,
+    const struct sockaddr* addr_from, const struct sockaddr* addr_to, int if_index_to,
+    unsigned char received_ecn, uint64_t current_time)
+{
+    picoquic_admission_ctx_t* admission = quic->admission;
+    int queue_class = (admission->is_pending_priority) ? 0 : 1;
+    picoquic_admission_entry_t* entry = NULL;
+
+    if (admission->nb_queued >= admission->max_queued && queue_class == 0 && admission->first[1] != NULL) {
+        /* Make room for the priority packet by dropping the oldest other one */
+        picoquic_admission_entry_t* evicted = admission->first[1];
+        admission->first[1] = evicted->next;
+        if (evicted->next == NULL) {
+            admission->last[1] = NULL;
+        }
+        admission->nb_queued--;
+        admission->stats.nb_shed_queue_full++;
+        free(evicted);
+    }
+
+    if (admission->nb_queued < admission->max_queued && length <= PICOQUIC_MAX_PACKET_SIZE) {
+        entry = (picoquic_admission_entry_t*)malloc(sizeof(picoquic_admission_entry_t));
+    }
+
+    if (entry == NULL) {
+        admission->stats.nb_shed_queue_full++;
+    }
+    else {
+        memset(entry, 0, sizeof(picoquic_admission_entry_t));
+        entry->arrival_time = current_time;
+        picoquic_store_addr(&entry->addr_from, addr_from);
+        picoquic_store_addr(&entry->addr_to, addr_to);
+        entry->if_index_to = if_index_to;
+        entry->received_ecn = received_ecn;
+        entry->length = length;
+        memcpy(entry->bytes, bytes, length);
+        if (admission->last[queue_class] == NULL) {
+            admission->first[queue_class] = entry;
+        }
+        else {
+            admission->last[queue_class]->next = entry;
+        }
+        admission->last[queue_class] = entry;
+        admission->nb_queued++;
+        admission->stats.nb_queued++;
+        if (admission->nb_queued > admission->stats.queue_depth_max) {
+            admission->stats.queue_depth_max = admission->nb_queued;
+        }
+    }
+}
+
+/* Time at which the next queued packet can be admitted, UINT64_MAX if the queue is empty */
+uint64_t picoquic_admission_next_time(picoquic_quic_t* quic, uint64_t current_time)
+{
+    uint64_t next_time = UINT64_MAX;
+    picoquic_admission_ctx_t* admission = quic->admission;
+
+    if (admission != NULL && admission->nb_queued > 0) {
+        picoquic_admission_refill(admission, current_time);
+        if (admission->credit >= 1000000ull) {
+            next_time = current_time;
+        }
+        else {
+            next_time = current_time + (1000000ull - admission->credit + admission->handshakes_per_second - 1) /
+                admission->handshakes_per_second;
+        }
+    }
+
+    return next_time;
+}
+
+/* Admit the queued packets for which there is budget, in class order.
+ * Returns the number of packets admitted.
+ */
+int picoquic_admission_process(picoquic_quic_t* quic, uint64_t current_time)
+{
+    int nb_admitted = 0;
+    picoquic_admission_ctx_t* admission = quic->admission;
+
+    if (admission != NULL && admission->nb_queued > 0 && !admission->is_processing) {
+        admission->is_processing = 1;
+        picoquic_admission_refill(admission, current_time);
+
+        for (int queue_class = 0; queue_class < 2; queue_class++) {
+            picoquic_admission_entry_t* entry;
+
+            while ((entry = admission->first[queue_class]) != NULL) {
+                int is_expired = (admission->max_queue_delay > 0 &&
+                    current_time > entry->arrival_time + admission->max_queue_delay);
+
+                if (!is_expired && admission->credit < 1000000ull) {
+                    break;
+                }
+                admission->first[queue_class] = entry->next;
+                if (entry->next == NULL) {
+                    admission->last[queue_class] = NULL;
+                }
+                admission->nb_queued--;
+
+                if (is_expired) {
+                    admission->stats.nb_shed_expired++;
+                }
+                else {
+                    picoquic_cnx_t* first_cnx = NULL;
+                    picoquic_cpu_mark_t cpu_mark;
+
+                    admission->credit -= 1000000ull;
+                    picoquic_cpu_mark(quic, &cpu_mark);
+                    (void)picoquic_incoming_packet_ts(quic, entry->bytes, entry->length,
+                        (struct sockaddr*)&entry->addr_from, (struct sockaddr*)&entry->addr_to,
+                        entry->if_index_to, entry->received_ecn, &first_cnx, entry->arrival_time, current_time);
+                    admission->stats.cpu_ticks += picoquic_cpu_elapsed(quic, &cpu_mark);
+                    admission->stats.queue_delay_total += current_time - entry->arrival_time;
+                    if (queue_class == 0) {
+                        admission->stats.nb_admitted_priority++;
+                    }
+                    else {
+                        admission->stats.nb_admitted++;
+                    }
+                    nb_admitted++;
+                }
+                free(entry);
+            }
+        }
+        admission->is_processing = 0;
+    }
+
+    return nb_admitted;
+}
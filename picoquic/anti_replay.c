@@ -0,0 +1,430 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Anti-replay filter for 0-RTT.
+*
+* The server remembers the identifiers of the session tickets used in the
+* recent past, and refuses the early data of a second connection using the
+* same ticket. The connection itself proceeds as a regular resumption, so a
+* replayed Client Hello cannot cause 0-RTT data to be processed twice.
+*
+* The identifiers are kept in Bloom filters, one per time bucket. Time is
+* divided in epochs of "window" microseconds; the filter of the current
+* epoch receives the new identifiers, and lookups test both the current and
+* the previous epoch. When an epoch starts, the filter of epoch n-2 is
+* cleared and reused. The window shall be at least as large as the tolerance
+* of the ticket age check, so that Client Hellos old enough to fall out of
+* the filters are rejected by that check. The memory used is fixed, and does
+* not grow with the number of tickets.
+*
+* The filters can be kept in memory, or in a file mapped by several server
+* processes, so that the shards of a server farm detect replays across
+* processes. Bits are set with atomic OR operations; the epoch marker of a
+* bucket is claimed with a compare and swap by the process that clears it.
+* Two processes testing the same identifier at exactly the same time may
+* both miss the replay, which leaves a window of a few instructions.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "tls_api.h"
+
+#define PICOQUIC_ANTI_REPLAY_MAGIC 0x50514152
+#define PICOQUIC_ANTI_REPLAY_INIT 0x50514100
+#define PICOQUIC_ANTI_REPLAY_FORMAT 1
+#define PICOQUIC_ANTI_REPLAY_BUCKETS 2
+#define PICOQUIC_ANTI_REPLAY_NB_HASH 4
+#define PICOQUIC_ANTI_REPLAY_WINDOW 10000000ull
+#define PICOQUIC_ANTI_REPLAY_CLEARING UINT64_MAX
+#define PICOQUIC_ANTI_REPLAY_WAIT 100000
+
+typedef struct st_picoquic_anti_replay_header_t {
+    volatile uint32_t magic;
+    uint32_t format;
+    uint64_t nb_words;
+    uint64_t window;
+    uint8_t hash_seed[16];
+    uint8_t reserved[24];
+} picoquic_anti_replay_header_t;
+
+/* Each bucket starts with its epoch marker, 0 if never used, followed
+ * by nb_words 64 bit words of filter bits. */
+struct st_picoquic_anti_replay_t {
+    uint8_t* base;
+    size_t map_size;
+    uint64_t nb_words;
+    uint64_t window;
+    uint64_t nb_checked;
+    uint64_t nb_rejected;
+    int is_shared;
+#ifdef _WINDOWS
+    HANDLE file_handle;
+    HANDLE map_handle;
+#else
+    int fd;
+#endif
+};
+
+#ifdef _WINDOWS
+#define PICOQUIC_ANTI_REPLAY_LOAD32(p) ((uint32_t)InterlockedCompareExchange((LONG volatile*)(p), 0, 0))
+#define PICOQUIC_ANTI_REPLAY_CAS32(p, e, v) (InterlockedCompareExchange((LONG volatile*)(p), (LONG)(v), (LONG)(e)) == (LONG)(e))
+#define PICOQUIC_ANTI_REPLAY_CAS64(p, e, v) (InterlockedCompareExchange64((LONG64 volatile*)(p), (LONG64)(v), (LONG64)(e)) == (LONG64)(e))
+#define PICOQUIC_ANTI_REPLAY_OR64(p, v) ((uint64_t)InterlockedOr64((LONG64 volatile*)(p), (LONG64)(v)))
+#define PICOQUIC_ANTI_REPLAY_YIELD() Sleep(0)
+#else
+#define PICOQUIC_ANTI_REPLAY_LOAD32(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+static int picoquic_anti_replay_cas32(volatile uint32_t* p, uint32_t expected, uint32_t v)
+{
+    return __atomic_compare_exchange_n(p, &expected, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+static int picoquic_anti_replay_cas64(volatile uint64_t* p, uint64_t expected, uint64_t v)
+{
+    return __atomic_compare_exchange_n(p, &expected, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+#define PICOQUIC_ANTI_REPLAY_CAS32(p, e, v) picoquic_anti_replay_cas32((p), (e), (v))
+#define PICOQUIC_ANTI_REPLAY_CAS64(p, e, v) picoquic_anti_replay_cas64((p), (e), (v))
+#define PICOQUIC_ANTI_REPLAY_OR64(p, v) __atomic_fetch_or((p), (v), __ATOMIC_ACQ_REL)
+#define PICOQUIC_ANTI_REPLAY_YIELD() (void)sched_yield()
+#endif
+
+static picoquic_anti_replay_header_t* picoquic_anti_replay_header(picoquic_anti_replay_t* filter)
+{
+    return (picoquic_anti_replay_header_t*)filter->base;
+}
+
+static volatile uint64_t* picoquic_anti_replay_bucket(picoquic_anti_replay_t* filter, uint64_t epoch)
+{
+    return ((volatile uint64_t*)(filter->base + sizeof(picoquic_anti_replay_header_t))) +
+        (epoch % PICOQUIC_ANTI_REPLAY_BUCKETS) * (filter->nb_words + 1);
+}
+
+static size_t picoquic_anti_replay_map_size(uint64_t nb_words)
+{
+    return sizeof(picoquic_anti_replay_header_t) +
+        (size_t)(PICOQUIC_ANTI_REPLAY_BUCKETS * (nb_words + 1) * sizeof(uint64_t));
+}
+
+static void picoquic_anti_replay_delete(picoquic_anti_replay_t* filter)
+{
+    if (filter->is_shared) {
+#ifdef _WINDOWS
+        if (filter->base != NULL) {
+            (void)UnmapViewOfFile(filter->base);
+        }
+        if (filter->map_handle != NULL) {
+            (void)CloseHandle(filter->map_handle);
+        }
+        if (filter->file_handle != INVALID_HANDLE_VALUE) {
+            (void)CloseHandle(filter->file_handle);
+        }
+#else
+        if (filter->base != NULL) {
+            (void)munmap(filter->base, filter->map_size);
+        }
+        if (filter->fd >= 0) {
+            (void)close(filter->fd);
+        }
+#endif
+    }
+    else if (filter->base != NULL) {
+        free(filter->base);
+    }
+    free(filter);
+}
+
+static picoquic_anti_replay_t* picoquic_anti_replay_alloc(size_t nb_bits, uint64_t window)
+{
+    picoquic_anti_replay_t* filter = (picoquic_anti_replay_t*)malloc(sizeof(picoquic_anti_replay_t));
+
+    if (filter != NULL) {
+        memset(filter, 0, sizeof(picoquic_anti_replay_t));
+        filter->nb_words = (nb_bits + 63) / 64;
+        filter->window = (window == 0) ? PICOQUIC_ANTI_REPLAY_WINDOW : window;
+        filter->map_size = picoquic_anti_replay_map_size(filter->nb_words);
+#ifdef _WINDOWS
+        filter->file_handle = INVALID_HANDLE_VALUE;
+#else
+        filter->fd = -1;
+#endif
+    }
+
+    return filter;
+}
+
+/* Open or create the file, and map it, as done for the shared ticket store */
+static int picoquic_anti_replay_map(picoquic_anti_replay_t* filter, char const* file_name)
+{
+    int ret = 0;
+
+    filter->is_shared = 1;
+#ifdef _WINDOWS
+    filter->file_handle = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (filter->file_handle == INVALID_HANDLE_VALUE) {
+        ret = -1;
+    }
+    else {
+        LARGE_INTEGER file_size;
+
+        if (!GetFileSizeEx(filter->file_handle, &file_size) ||
+            ((uint64_t)file_size.QuadPart != 0 && (uint64_t)file_size.QuadPart != (uint64_t)filter->map_size)) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else {
+            filter->map_handle = CreateFileMappingA(filter->file_handle, NULL, PAGE_READWRITE,
+                (DWORD)(((uint64_t)filter->map_size) >> 32), (DWORD)(filter->map_size & 0xFFFFFFFF), NULL);
+            if (filter->map_handle == NULL ||
+                (filter->base = (uint8_t*)MapViewOfFile(filter->map_handle, FILE_MAP_ALL_ACCESS, 0, 0, filter->map_size)) == NULL) {
+                ret = -1;
+            }
+        }
+    }
+#else
+    filter->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+    if (filter->fd < 0) {
+        ret = -1;
+    }
+    else {
+        struct stat st;
+
+        if (fstat(filter->fd, &st) != 0 ||
+            (st.st_size != 0 && (uint64_t)st.st_size != (uint64_t)filter->map_size)) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else if (st.st_size == 0 && ftruncate(filter->fd, (off_t)filter->map_size) != 0) {
+            ret = -1;
+        }
+        else {
+            filter->base = (uint8_t*)mmap(NULL, filter->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, filter->fd, 0);
+            if (filter->base == (uint8_t*)MAP_FAILED) {
+                filter->base = NULL;
+                ret = -1;
+            }
+        }
+    }
+#endif
+    return ret;
+}
+
+/* The first process to map the file sets the header, the others verify
+ * that it matches their parameters. */
+static int picoquic_anti_replay_init_header(picoquic_quic_t* quic, picoquic_anti_replay_t* filter)
+{
+    int ret = 0;
+    picoquic_anti_replay_header_t* header = picoquic_anti_replay_header(filter);
+
+    if (PICOQUIC_ANTI_REPLAY_CAS32(&header->magic, 0, PICOQUIC_ANTI_REPLAY_INIT)) {
+        header->format = PICOQUIC_ANTI_REPLAY_FORMAT;
+        header->nb_words = filter->nb_words;
+        header->window = filter->window;
+        picoquic_crypto_random(quic, header->hash_seed, sizeof(header->hash_seed));
+        PICOQUIC_TELEMETRY_STORE32(&header->magic, PICOQUIC_ANTI_REPLAY_MAGIC);
+    }
+    else {
+        int nb_wait = 0;
+
+        while (PICOQUIC_ANTI_REPLAY_LOAD32(&header->magic) == PICOQUIC_ANTI_REPLAY_INIT &&
+            nb_wait < PICOQUIC_ANTI_REPLAY_WAIT) {
+            PICOQUIC_ANTI_REPLAY_YIELD();
+            nb_wait++;
+        }
+        if (PICOQUIC_ANTI_REPLAY_LOAD32(&header->magic) != PICOQUIC_ANTI_REPLAY_MAGIC ||
+            header->format != PICOQUIC_ANTI_REPLAY_FORMAT ||
+            header->nb_words != filter->nb_words ||
+            header->window != filter->window) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_set_anti_replay(picoquic_quic_t* quic, size_t nb_bits, uint64_t window)
+{
+    int ret = 0;
+
+    picoquic_anti_replay_free(quic);
+
+    if (nb_bits > 0) {
+        picoquic_anti_replay_t* filter = picoquic_anti_replay_alloc(nb_bits, window);
+
+        if (filter == NULL ||
+            (filter->base = (uint8_t*)malloc(filter->map_size)) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+            if (filter != NULL) {
+                picoquic_anti_replay_delete(filter);
+            }
+        }
+        else {
+            memset(filter->base, 0, filter->map_size);
+            picoquic_anti_replay_header(filter)->magic = PICOQUIC_ANTI_REPLAY_MAGIC;
+            picoquic_anti_replay_header(filter)->format = PICOQUIC_ANTI_REPLAY_FORMAT;
+            picoquic_anti_replay_header(filter)->nb_words = filter->nb_words;
+            picoquic_anti_replay_header(filter)->window = filter->window;
+            picoquic_crypto_random(quic, picoquic_anti_replay_header(filter)->hash_seed,
+                sizeof(picoquic_anti_replay_header(filter)->hash_seed));
+            quic->anti_replay = filter;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_attach_shared_anti_replay(picoquic_quic_t* quic, char const* file_name, size_t nb_bits, uint64_t window)
+{
+    int ret = 0;
+
+    picoquic_anti_replay_free(quic);
+
+    if (file_name == NULL || nb_bits == 0 ||
+        nb_bits / 64 > (SIZE_MAX - sizeof(picoquic_anti_replay_header_t)) / (PICOQUIC_ANTI_REPLAY_BUCKETS * sizeof(uint64_t)) - 1) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        picoquic_anti_replay_t* filter = picoquic_anti_replay_alloc(nb_bits, window);
+
+        if (filter == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if ((ret = picoquic_anti_replay_map(filter, file_name)) != 0 ||
+            (ret = picoquic_anti_replay_init_header(quic, filter)) != 0) {
+            DBG_PRINTF("Cannot attach anti-replay filter <%s>, ret = 0x%x", file_name, ret);
+            picoquic_anti_replay_delete(filter);
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else {
+            quic->anti_replay = filter;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_anti_replay_free(picoquic_quic_t* quic)
+{
+    if (quic->anti_replay != NULL) {
+        picoquic_anti_replay_delete(quic->anti_replay);
+        quic->anti_replay = NULL;
+    }
+}
+
+uint64_t picoquic_get_anti_replay_rejected(picoquic_quic_t* quic)
+{
+    return (quic->anti_replay == NULL) ? 0 : quic->anti_replay->nb_rejected;
+}
+
+/* Make sure the bucket is ready for the epoch, clearing it if it holds an
+ * older epoch. Epochs are numbered from 1, so that 0 marks unused buckets.
+ * Returns the epoch now held by the bucket, which may be newer than the
+ * requested one if another process has a clock slightly ahead. */
+static uint64_t picoquic_anti_replay_open_bucket(picoquic_anti_replay_t* filter, uint64_t epoch)
+{
+    volatile uint64_t* bucket = picoquic_anti_replay_bucket(filter, epoch);
+    uint64_t bucket_epoch = PICOQUIC_TELEMETRY_LOAD64(bucket);
+    int nb_wait = 0;
+
+    while (bucket_epoch < epoch || bucket_epoch == PICOQUIC_ANTI_REPLAY_CLEARING) {
+        if (bucket_epoch != PICOQUIC_ANTI_REPLAY_CLEARING &&
+            PICOQUIC_ANTI_REPLAY_CAS64(bucket, bucket_epoch, PICOQUIC_ANTI_REPLAY_CLEARING)) {
+            memset((void*)(bucket + 1), 0, (size_t)(filter->nb_words * sizeof(uint64_t)));
+            PICOQUIC_TELEMETRY_STORE64(bucket, epoch);
+            bucket_epoch = epoch;
+        }
+        else if (nb_wait >= PICOQUIC_ANTI_REPLAY_WAIT) {
+            /* Give up waiting for a stalled writer, and use the bucket as is. */
+            bucket_epoch = epoch;
+        }
+        else {
+            if (bucket_epoch == PICOQUIC_ANTI_REPLAY_CLEARING) {
+                PICOQUIC_ANTI_REPLAY_YIELD();
+                nb_wait++;
+            }
+            bucket_epoch = PICOQUIC_TELEMETRY_LOAD64(bucket);
+        }
+    }
+
+    return bucket_epoch;
+}
+
+/* Test whether the ticket identifier was already seen during the current
+ * or the previous epoch, and add it to the filter of the current epoch.
+ * Returns 1 if the identifier is a replay. The bit positions are derived
+ * from a keyed hash of the identifier by double hashing. */
+int picoquic_anti_replay_check(picoquic_quic_t* quic, uint64_t ticket_id, uint64_t current_time)
+{
+    int is_replay = 0;
+    picoquic_anti_replay_t* filter = quic->anti_replay;
+
+    if (filter != NULL) {
+        uint8_t id_bytes[8];
+        uint64_t epoch = current_time / filter->window + 1;
+        uint64_t h;
+        uint64_t h1;
+        uint64_t h2;
+        volatile uint64_t* current_bucket;
+        volatile uint64_t* previous_bucket;
+        uint64_t previous_epoch;
+        int was_set_current = 1;
+        int was_set_previous;
+
+        picoformat_64(id_bytes, ticket_id);
+        h = picohash_siphash(id_bytes, sizeof(id_bytes), picoquic_anti_replay_header(filter)->hash_seed);
+        h1 = h & 0xFFFFFFFF;
+        h2 = (h >> 32) | 1;
+
+        epoch = picoquic_anti_replay_open_bucket(filter, epoch);
+        current_bucket = picoquic_anti_replay_bucket(filter, epoch);
+        previous_bucket = picoquic_anti_replay_bucket(filter, epoch - 1);
+        previous_epoch = PICOQUIC_TELEMETRY_LOAD64(previous_bucket);
+        was_set_previous = (previous_epoch == epoch - 1 && previous_epoch != 0);
+
+        for (uint64_t i = 0; i < PICOQUIC_ANTI_REPLAY_NB_HASH; i++) {
+            uint64_t bit = (h1 + i * h2) % (filter->nb_words * 64);
+            uint64_t mask = 1ull << (bit % 64);
+
+            if ((PICOQUIC_ANTI_REPLAY_OR64(&current_bucket[1 + bit / 64], mask) & mask) == 0) {
+                was_set_current = 0;
+            }
+            if (was_set_previous && (PICOQUIC_TELEMETRY_LOAD64(&previous_bucket[1 + bit / 64]) & mask) == 0) {
+                was_set_previous = 0;
+            }
+        }
+        is_replay = was_set_current || was_set_previous;
+
+        filter->nb_checked++;
+        if (is_replay) {
+            filter->nb_rejected++;
+        }
+    }
+
+    return is_replay;
+}
@@ -113,26 +113,27 @@ typedef enum {
 
 #define BBRMinRTTFilterLen 10000000 /* Length of min rtt filter -- 10 seconds. */
 #define BBRRTTJitterBufferLen 7 /* Number of RTT amples retained to filter out jitter */
-#define BBRProbeRTTCwndGain 0.5
+/* Gains are expressed in Q16 fixed point, see PICOQUIC_CC_Q16 */
+#define BBRProbeRTTCwndGain PICOQUIC_CC_Q16(0.5)
 #define BBRProbeRTTDuration 200000 /* 200msec, 200000 microsecs */
 #define BBRProbeRTTInterval 5000000 /* 5 seconds */
 
-#define BBRStartupPacingGain 2.77 /* constant, 4*ln(2), approx 2.77 */
-#define BBRStartupCwndGain 2.0 /* constant */
+#define BBRStartupPacingGain PICOQUIC_CC_Q16(2.77) /* constant, 4*ln(2), approx 2.77 */
+#define BBRStartupCwndGain PICOQUIC_CC_Q16(2.0) /* constant */
 #define BBRStartupIncreaseThreshold 1.25
 
-#define BBRStartupResumePacingGain 1.25 /* arbitrary */
-#define BBRStartupResumeCwndGain 1.25 /* arbitrary */
+#define BBRStartupResumePacingGain PICOQUIC_CC_Q16(1.25) /* arbitrary */
+#define BBRStartupResumeCwndGain PICOQUIC_CC_Q16(1.25) /* arbitrary */
 #define BBRStartupResumeIncreaseThreshold 1.125
 
-#define BBRProbeBwDownPacingGain 0.9
-#define BBRProbeBwDownCwndGain 2.0
-#define BBRProbeBwCruisePacingGain 1.0
-#define BBRProbeBwCruiseCwndGain 2.0
-#define BBRProbeBwRefillPacingGain 1.0
-#define BBRProbeBwRefillCwndGain 2.0
-#define BBRProbeBwUpPacingGain 1.25
-#define BBRProbeBwUpCwndGain 2.25
+#define BBRProbeBwDownPacingGain PICOQUIC_CC_Q16(0.9)
+#define BBRProbeBwDownCwndGain PICOQUIC_CC_Q16(2.0)
+#define BBRProbeBwCruisePacingGain PICOQUIC_CC_Q16(1.0)
+#define BBRProbeBwCruiseCwndGain PICOQUIC_CC_Q16(2.0)
+#define BBRProbeBwRefillPacingGain PICOQUIC_CC_Q16(1.0)
+#define BBRProbeBwRefillCwndGain PICOQUIC_CC_Q16(2.0)
+#define BBRProbeBwUpPacingGain PICOQUIC_CC_Q16(1.25)
+#define BBRProbeBwUpCwndGain PICOQUIC_CC_Q16(2.25)
 
 #define BBRAppLimitedRoundsThreshold 3
 
@@ -171,10 +172,10 @@ typedef struct st_picoquic_bbr_state_t {
     uint64_t send_quantum;
     uint64_t prior_cwnd;
     /* Pacing state */
-    double pacing_gain;
+    uint64_t pacing_gain; /* Q16 */
     uint64_t next_departure_time; /* earliest departure time of next packet, per pacing conditions -- new in BBRv3 */
     /* CWND state */
-    double cwnd_gain;
+    uint64_t cwnd_gain; /* Q16 */
     unsigned int packet_conservation : 1; /* whether BBR is using conservation dynamics */
     /*  Data Rate parameters: */
     uint64_t max_bw; /* windowed maximum recent bandwidth sample -- new in BBRv3 */
@@ -358,10 +359,10 @@ static void BBRUpdateMaxBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* pat
 static void BBRInitPacingRate(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x);
 static void BBRResetCongestionSignals(picoquic_bbr_state_t* bbr_state);
 static void BBRResetLowerBounds(picoquic_bbr_state_t* bbr_state);
-static uint64_t BBRInflightWithBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, double gain, uint64_t bw);
+static uint64_t BBRInflightWithBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t gain, uint64_t bw);
 static void BBRUpdateMaxInflight(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x);
 static uint64_t BBRInflightWithHeadroom(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x);
-static uint64_t BBRBDPMultiple(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, double gain);
+static uint64_t BBRBDPMultiple(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t gain);
 static void BBRAdaptUpperBounds(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, bbr_per_ack_state_t* rs, uint64_t current_time);
 static int InLossRecovery(picoquic_bbr_state_t* bbr_state);
 static int BBRHasElapsedInPhase(picoquic_bbr_state_t* bbr_state, uint64_t interval, uint64_t current_time);
@@ -865,17 +866,18 @@ static void BBRCheckRecovery(picoquic_bbr_state_t* bbr_state, picoquic_path_t* p
     }
 }
 
-/* Computing the congestion window */
-static uint64_t BBRBDPMultipleWithBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, double gain, uint64_t bw)
+/* Computing the congestion window. These functions run on every ACK, so
+ * the gain is applied in Q16 fixed point rather than in floating point. */
+static uint64_t BBRBDPMultipleWithBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t gain, uint64_t bw)
 {
     if (bbr_state->min_rtt == UINT64_MAX) {
         return PICOQUIC_CWIN_INITIAL*path_x->send_mtu; /* no valid RTT samples yet */
     }
     bbr_state->bdp = (bw * bbr_state->min_rtt) / 1000000;
-    return (uint64_t)(gain * (double)bbr_state->bdp);
+    return picoquic_cc_apply_gain_q16(bbr_state->bdp, gain);
 }
 
-static uint64_t BBRBDPMultiple(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, double gain)
+static uint64_t BBRBDPMultiple(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t gain)
 {
     return BBRBDPMultipleWithBw(bbr_state, path_x, gain, bbr_state->bw);
 }
@@ -900,13 +902,13 @@ static uint64_t BBRQuantizationBudget(picoquic_bbr_state_t* bbr_state, picoquic_
     return inflight;
 }
 
-static uint64_t BBRInflightWithBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, double gain, uint64_t bw)
+static uint64_t BBRInflightWithBw(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t gain, uint64_t bw)
 {
     uint64_t inflight = BBRBDPMultipleWithBw(bbr_state, path_x, gain, bw);
     return BBRQuantizationBudget(bbr_state, path_x, inflight);
 }
 
-static uint64_t BBRInflight(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, double gain)
+static uint64_t BBRInflight(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t gain)
 {
     return BBRInflightWithBw(bbr_state, path_x, gain, bbr_state->bw);
 }
@@ -937,13 +939,13 @@ static void BBRInitPacingRate(picoquic_bbr_state_t* bbr_state, picoquic_path_t*
     if (path_x->smoothed_rtt != PICOQUIC_INITIAL_RTT || path_x->rtt_variant != 0) {
         initial_rtt = path_x->smoothed_rtt;
     }
-    double nominal_bandwidth = ((double)(1000000ull * PICOQUIC_CWIN_INITIAL)) / (double)initial_rtt;
-    bbr_state->pacing_rate = BBRStartupPacingGain * nominal_bandwidth;
+    uint64_t nominal_bandwidth = (1000000ull * PICOQUIC_CWIN_INITIAL) / initial_rtt;
+    bbr_state->pacing_rate = (double)picoquic_cc_apply_gain_q16(nominal_bandwidth, BBRStartupPacingGain);
 }
 
-static void BBRSetPacingRateWithGain(picoquic_bbr_state_t* bbr_state, double pacing_gain)
+static void BBRSetPacingRateWithGain(picoquic_bbr_state_t* bbr_state, uint64_t pacing_gain)
 {
-    double rate = pacing_gain * ((double)(bbr_state->bw * (100 - BBRPacingMarginPercent))) / (double)100;
+    double rate = (double)(picoquic_cc_apply_gain_q16(bbr_state->bw, pacing_gain) * (100 - BBRPacingMarginPercent) / 100);
 
     if (bbr_state->state == picoquic_bbr_alg_startup_resume &&
         !bbr_state->filled_pipe &&
@@ -1255,7 +1257,7 @@ static void BBRHandleRestartFromIdle(picoquic_bbr_state_t* bbr_state, picoquic_p
         bbr_state->idle_restart = 1;
         bbr_state->extra_acked_interval_start = current_time;
         if (IsInAProbeBWState(bbr_state)) {
-            BBRSetPacingRateWithGain(bbr_state, 1);
+            BBRSetPacingRateWithGain(bbr_state, PICOQUIC_CC_Q16_ONE);
         }
         else if (bbr_state->state == picoquic_bbr_alg_probe_rtt) {
             BBRCheckProbeRTTDone(bbr_state, current_time);
@@ -1487,7 +1489,7 @@ static void BBRHandleProbeRTT(picoquic_bbr_state_t* bbr_state, picoquic_path_t *
 static void BBREnterProbeRTT(picoquic_bbr_state_t* bbr_state, picoquic_path_t * path_x)
 {
     bbr_state->state = picoquic_bbr_alg_probe_rtt;
-    bbr_state->pacing_gain = 1.0;
+    bbr_state->pacing_gain = PICOQUIC_CC_Q16_ONE;
     bbr_state->cwnd_gain = BBRProbeRTTCwndGain;  /* 0.5 */
     path_x->is_cca_probing_up = 0;
 }
@@ -1629,7 +1631,7 @@ static int BBRCheckTimeToCruise(picoquic_bbr_state_t* bbr_state, picoquic_path_t
     if (path_x->bytes_in_transit > BBRInflightWithHeadroom(bbr_state, path_x)) {
         return 0; /* not enough headroom */
     }
-    if (path_x->bytes_in_transit <= BBRInflightWithBw(bbr_state, path_x, 1.0, bbr_state->max_bw)) {
+    if (path_x->bytes_in_transit <= BBRInflightWithBw(bbr_state, path_x, PICOQUIC_CC_Q16_ONE, bbr_state->max_bw)) {
         return 1;  /* inflight <= estimated BDP */
     }
     return 0;
@@ -1907,7 +1909,7 @@ static void BBRUpdateProbeBWCyclePhase(picoquic_bbr_state_t* bbr_state, picoquic
             bbr_state->min_rtt > PICOQUIC_MINRTT_THRESHOLD &&
             BBRExpTest(bbr_state, do_exit_probeBW_up_on_delay) &&
             (bbr_state->nb_rtt_excess > 0 ||
-                path_x->bytes_in_transit > BBRInflightWithBw(bbr_state, path_x, 1.25, bbr_state->max_bw))) {
+                path_x->bytes_in_transit > BBRInflightWithBw(bbr_state, path_x, PICOQUIC_CC_Q16(1.25), bbr_state->max_bw))) {
             BBRStartProbeBW_DOWN(bbr_state, path_x, current_time);
         }
         break;
@@ -1934,7 +1936,7 @@ static void BBREnterDrain(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path
 {
     path_x->is_ssthresh_initialized = 1; /* Picoquic specific: notify transport that the startup phase is complete */
     bbr_state->state = picoquic_bbr_alg_drain;
-    bbr_state->pacing_gain = 1.0 / BBRStartupCwndGain;  /* pace slowly */
+    bbr_state->pacing_gain = (PICOQUIC_CC_Q16_ONE * PICOQUIC_CC_Q16_ONE) / BBRStartupCwndGain;  /* pace slowly */
     bbr_state->cwnd_gain = BBRStartupCwndGain;   /* maintain cwnd */
 
     path_x->is_cca_probing_up = 0;
@@ -1942,7 +1944,7 @@ static void BBREnterDrain(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path
 
 static void BBRCheckDrain(picoquic_bbr_state_t* bbr_state, picoquic_path_t* path_x, uint64_t current_time)
 {
-    if (bbr_state->state == picoquic_bbr_alg_drain && path_x->bytes_in_transit <= BBRInflight(bbr_state, path_x, 1.0)) {
+    if (bbr_state->state == picoquic_bbr_alg_drain && path_x->bytes_in_transit <= BBRInflight(bbr_state, path_x, PICOQUIC_CC_Q16_ONE)) {
         BBREnterProbeBW(bbr_state, path_x, current_time);  /* we estimate that the queue is drained */
     }
 }
@@ -2464,6 +2466,99 @@ static void picoquic_bbr_notify(
     }
 }
 
+/* Export and import the state of congestion control.
+ * The snapshot carries the path model: the bandwidth and inflight bounds,
+ * the min RTT and its age, and the aggregation estimate. If the pipe was
+ * filled when exporting, the import restores the model and enters ProbeBW
+ * directly, instead of going through startup again. Otherwise, only the
+ * RTT and bandwidth estimates are restored and startup continues.
+ */
+static uint8_t* picoquic_bbr_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_bbr_state_t* bbr_state = (picoquic_bbr_state_t*)path_x->congestion_alg_state;
+    uint64_t values[8];
+
+    values[0] = bbr_state->filled_pipe;
+    values[1] = bbr_state->max_bw;
+    values[2] = bbr_state->bw_hi;
+    values[3] = bbr_state->inflight_hi;
+    values[4] = bbr_state->min_rtt;
+    values[5] = picoquic_cc_snapshot_age(bbr_state->min_rtt_stamp, current_time);
+    values[6] = bbr_state->extra_acked;
+    values[7] = bbr_state->full_bw;
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 8);
+}
+
+static const uint8_t* picoquic_bbr_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_bbr_state_t* bbr_state = (picoquic_bbr_state_t*)path_x->congestion_alg_state;
+    uint64_t values[8];
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 8)) != NULL) {
+        if (values[4] == 0) {
+            bytes = NULL;
+        }
+        else {
+            bbr_state->min_rtt = values[4];
+            bbr_state->min_rtt_stamp = picoquic_cc_snapshot_stamp(values[5], current_time);
+            bbr_state->probe_rtt_min_delay = bbr_state->min_rtt;
+            bbr_state->probe_rtt_min_stamp = bbr_state->min_rtt_stamp;
+            for (int i = 0; i < BBRMaxBwFilterLen; i++) {
+                bbr_state->MaxBwFilter[i] = values[1];
+            }
+            bbr_state->max_bw = values[1];
+
+            if (values[0]) {
+                bbr_state->bw_hi = values[2];
+                bbr_state->inflight_hi = values[3];
+                for (int i = 0; i < BBRExtraAckedFilterLen; i++) {
+                    bbr_state->ExtraACKedFilter[i] = values[6];
+                }
+                bbr_state->extra_acked = values[6];
+                bbr_state->extra_acked_interval_start = current_time;
+                bbr_state->extra_acked_delivered = 0;
+                bbr_state->full_bw = values[7];
+                bbr_state->full_bw_count = 0;
+                bbr_state->filled_pipe = 1;
+                path_x->is_ssthresh_initialized = 1;
+                BBRResetCongestionSignals(bbr_state);
+                BBRResetLowerBounds(bbr_state);
+                BBRBoundBWForModel(bbr_state);
+                BBREnterProbeBW(bbr_state, path_x, current_time);
+            }
+            else {
+                BBRBoundBWForModel(bbr_state);
+            }
+            BBRSetPacingRate(bbr_state);
+            BBRSetSendQuantum(bbr_state, path_x);
+            BBRUpdateMaxInflight(bbr_state, path_x);
+
+            if (bbr_state->state == picoquic_bbr_alg_startup_long_rtt) {
+                picoquic_update_pacing_data(cnx, path_x, 1);
+            }
+            else if (bbr_state->pacing_rate > 0) {
+                picoquic_update_pacing_rate(cnx, path_x, bbr_state->pacing_rate, bbr_state->send_quantum);
+            }
+        }
+    }
+
+    return bytes;
+}
+
+/* Used by the adaptive ACK frequency, which asks for more frequent ACKs
+ * while BBR probes for bandwidth. */
+int picoquic_bbr_is_probing(picoquic_path_t* path_x)
+{
+    picoquic_bbr_state_t* bbr_state = (picoquic_bbr_state_t*)path_x->congestion_alg_state;
+
+    return (bbr_state != NULL && (bbr_state->state == picoquic_bbr_alg_startup ||
+        bbr_state->state == picoquic_bbr_alg_startup_long_rtt ||
+        bbr_state->state == picoquic_bbr_alg_startup_resume ||
+        bbr_state->state == picoquic_bbr_alg_probe_bw_refill ||
+        bbr_state->state == picoquic_bbr_alg_probe_bw_up));
+}
+
 /* Observe the state of congestion control */
 
 void picoquic_bbr_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint64_t* cc_param)
@@ -2480,7 +2575,9 @@ picoquic_congestion_algorithm_t picoquic_bbr_algorithm_struct = {
     picoquic_bbr_init,
     picoquic_bbr_notify,
     picoquic_bbr_delete,
-    picoquic_bbr_observe
+    picoquic_bbr_observe,
+    picoquic_bbr_export,
+    picoquic_bbr_import
 };
 
 picoquic_congestion_algorithm_t* picoquic_bbr_algorithm = &picoquic_bbr_algorithm_struct;
\ No newline at end of file
@@ -1320,6 +1320,68 @@ static void picoquic_bbr1_notify(
     }
 }
 
+/* Export and import the state of congestion control.
+ * The snapshot carries the bottleneck bandwidth, the RTT propagation
+ * delay and its age. If the pipe was filled when exporting, the import
+ * enters ProbeBW directly; otherwise startup continues with the restored
+ * estimates.
+ */
+static uint8_t* picoquic_bbr1_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_bbr1_state_t* bbr1_state = (picoquic_bbr1_state_t*)path_x->congestion_alg_state;
+    uint64_t values[5];
+
+    values[0] = bbr1_state->filled_pipe;
+    values[1] = bbr1_state->btl_bw;
+    values[2] = bbr1_state->rt_prop;
+    values[3] = picoquic_cc_snapshot_age(bbr1_state->rt_prop_stamp, current_time);
+    values[4] = bbr1_state->full_bw;
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 5);
+}
+
+static const uint8_t* picoquic_bbr1_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_bbr1_state_t* bbr1_state = (picoquic_bbr1_state_t*)path_x->congestion_alg_state;
+    uint64_t values[5];
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 5)) != NULL) {
+        if (values[2] == 0) {
+            bytes = NULL;
+        }
+        else {
+            bbr1_state->rt_prop = values[2];
+            bbr1_state->rt_prop_stamp = picoquic_cc_snapshot_stamp(values[3], current_time);
+            for (int i = 0; i < BBR1_BTL_BW_FILTER_LENGTH; i++) {
+                bbr1_state->btl_bw_filter[i] = values[1];
+            }
+            bbr1_state->btl_bw = values[1];
+
+            if (values[0]) {
+                bbr1_state->full_bw = values[4];
+                bbr1_state->full_bw_count = 3;
+                bbr1_state->filled_pipe = 1;
+                bbr1_state->next_round_delivered = path_x->delivered;
+                bbr1_state->congestion_sequence = picoquic_cc_get_sequence_number(cnx, path_x);
+                path_x->is_ssthresh_initialized = 1;
+                BBR1EnterProbeBW(bbr1_state, path_x, current_time);
+            }
+            BBR1SetPacingRate(bbr1_state);
+            BBR1SetSendQuantum(bbr1_state, path_x);
+            BBR1UpdateTargetCwnd(bbr1_state);
+
+            if (bbr1_state->state == picoquic_bbr1_alg_startup_long_rtt) {
+                picoquic_update_pacing_data(cnx, path_x, 1);
+            }
+            else if (bbr1_state->pacing_rate > 0) {
+                picoquic_update_pacing_rate(cnx, path_x, bbr1_state->pacing_rate, bbr1_state->send_quantum);
+            }
+        }
+    }
+
+    return bytes;
+}
+
 /* Observe the state of congestion control */
 
 void picoquic_bbr1_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint64_t* cc_param)
@@ -1336,7 +1398,9 @@ picoquic_congestion_algorithm_t picoquic_bbr1_algorithm_struct = {
     picoquic_bbr1_init,
     picoquic_bbr1_notify,
     picoquic_bbr1_delete,
-    picoquic_bbr1_observe
+    picoquic_bbr1_observe,
+    picoquic_bbr1_export,
+    picoquic_bbr1_import
 };
 
 picoquic_congestion_algorithm_t* picoquic_bbr1_algorithm = &picoquic_bbr1_algorithm_struct;
\ No newline at end of file
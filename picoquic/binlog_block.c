@@ -0,0 +1,312 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Compressed blocks for the binary log, version 2 of the file format.
+*
+* The file starts with the same 16 bytes header as version 1, with the
+* version set to PICOQUIC_BINLOG_VERSION_BLOCKS. It is followed by a series
+* of independent blocks, each holding a sequence of version 1 chunks:
+*
+*   block_length (32 bits), number of bytes after this field
+*   codec (8 bits), see picoquic_binlog_codec_enum
+*   raw_length (varint), length of the uncompressed chunks
+*   first_time, last_time (varint), time range of the chunk events
+*   nb_cids (varint), followed by the connection IDs found in the block,
+*     or zero if there were more than PICOQUIC_BINLOG_BLOCK_MAX_CIDS
+*   payload, up to the end of the block
+*
+* Readers can skip the blocks that do not contain a connection or do not
+* overlap a time range without decompressing them. Blocks are written one
+* at a time, so the file remains readable up to the last complete block
+* if the writer stops.
+*
+* The codec is zstd or zlib if the library was found by the build, see
+* PICOQUIC_WITH_ZSTD and PICOQUIC_WITH_ZLIB, and the blocks are stored
+* uncompressed otherwise. Both favor speed over compression ratio, since
+* blocks are compressed while the connections are running.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "bytestream.h"
+#include "picoquic_binlog.h"
+#ifdef PICOQUIC_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PICOQUIC_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/* Fixed part of the block header, plus the varints and the CID list */
+#define PICOQUIC_BINLOG_BLOCK_HEADER_MAX (4 + 1 + 3 * 8 + 8 + \
+    PICOQUIC_BINLOG_BLOCK_MAX_CIDS * (1 + PICOQUIC_CONNECTION_ID_MAX_SIZE))
+
+picoquic_binlog_codec_enum picoquic_binlog_block_codec()
+{
+#if defined(PICOQUIC_WITH_ZSTD)
+    return picoquic_binlog_codec_zstd;
+#elif defined(PICOQUIC_WITH_ZLIB)
+    return picoquic_binlog_codec_zlib;
+#else
+    return picoquic_binlog_codec_none;
+#endif
+}
+
+/* Find the connection IDs and the time range of the chunks in a block */
+static void picoquic_binlog_block_scan(const uint8_t* raw, size_t raw_length, picoquic_binlog_block_header_t* header)
+{
+    size_t offset = 0;
+    int is_first = 1;
+
+    while (offset + 4 <= raw_length) {
+        size_t len = (size_t)PICOPARSE_32(raw + offset);
+        bytestream stream;
+        bytestream* s;
+        picoquic_connection_id_t cid;
+        uint64_t time = 0;
+
+        if (len > raw_length - offset - 4) {
+            break;
+        }
+        s = bytestream_ref_init(&stream, raw + offset + 4, len);
+        if (byteread_cid(s, &cid) == 0 && byteread_vint(s, &time) == 0) {
+            if (is_first || time < header->first_time) {
+                header->first_time = time;
+            }
+            if (is_first || time > header->last_time) {
+                header->last_time = time;
+            }
+            is_first = 0;
+            if (!header->is_cid_list_overflow) {
+                size_t i = 0;
+
+                while (i < header->nb_cids && picoquic_compare_connection_id(&cid, &header->cid[i]) != 0) {
+                    i++;
+                }
+                if (i >= header->nb_cids) {
+                    if (header->nb_cids < PICOQUIC_BINLOG_BLOCK_MAX_CIDS) {
+                        header->cid[header->nb_cids++] = cid;
+                    }
+                    else {
+                        header->is_cid_list_overflow = 1;
+                        header->nb_cids = 0;
+                    }
+                }
+            }
+        }
+        offset += 4 + len;
+    }
+}
+
+/* Compress the payload after the header. Returns the payload length, or 0
+ * if the data cannot be compressed, in which case it is stored. */
+static size_t picoquic_binlog_block_compress(picoquic_binlog_codec_enum codec, uint8_t* payload, size_t payload_max,
+    const uint8_t* raw, size_t raw_length)
+{
+    size_t payload_length = 0;
+
+    switch (codec) {
+#ifdef PICOQUIC_WITH_ZSTD
+    case picoquic_binlog_codec_zstd: {
+        size_t dest_len = ZSTD_compress(payload, payload_max, raw, raw_length, 1);
+        if (!ZSTD_isError(dest_len)) {
+            payload_length = dest_len;
+        }
+        break;
+    }
+#endif
+#ifdef PICOQUIC_WITH_ZLIB
+    case picoquic_binlog_codec_zlib: {
+        uLongf dest_len = (uLongf)payload_max;
+        if (compress2(payload, &dest_len, raw, (uLong)raw_length, Z_BEST_SPEED) == Z_OK) {
+            payload_length = (size_t)dest_len;
+        }
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    return (payload_length < raw_length) ? payload_length : 0;
+}
+
+static size_t picoquic_binlog_block_bound(size_t raw_length)
+{
+    size_t bound = raw_length;
+#ifdef PICOQUIC_WITH_ZSTD
+    if (ZSTD_compressBound(raw_length) > bound) {
+        bound = ZSTD_compressBound(raw_length);
+    }
+#endif
+#ifdef PICOQUIC_WITH_ZLIB
+    if (compressBound((uLong)raw_length) > bound) {
+        bound = compressBound((uLong)raw_length);
+    }
+#endif
+    return bound;
+}
+
+int picoquic_binlog_block_write(FILE* f, const uint8_t* raw, size_t raw_length)
+{
+    int ret = 0;
+    picoquic_binlog_block_header_t header;
+    size_t buffer_size = PICOQUIC_BINLOG_BLOCK_HEADER_MAX + picoquic_binlog_block_bound(raw_length);
+    uint8_t* buffer = NULL;
+
+    if (raw_length == 0) {
+        return 0;
+    }
+    if (raw_length > PICOQUIC_BINLOG_BLOCK_RAW_MAX || (buffer = (uint8_t*)malloc(buffer_size)) == NULL) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    picoquic_binlog_block_scan(raw, raw_length, &header);
+    header.raw_length = raw_length;
+    header.codec = picoquic_binlog_block_codec();
+
+    {
+        bytestream stream;
+        bytestream* s = bytestream_ref_init(&stream, buffer, PICOQUIC_BINLOG_BLOCK_HEADER_MAX);
+        size_t payload_length;
+
+        /* Leave room for the block length, which is only known after compression */
+        s->ptr = 4;
+        bytewrite_int8(s, (uint8_t)header.codec);
+        bytewrite_vint(s, header.raw_length);
+        bytewrite_vint(s, header.first_time);
+        bytewrite_vint(s, header.last_time);
+        bytewrite_vint(s, header.nb_cids);
+        for (size_t i = 0; i < header.nb_cids; i++) {
+            bytewrite_cid(s, &header.cid[i]);
+        }
+        header.header_length = bytestream_length(s);
+
+        payload_length = picoquic_binlog_block_compress(header.codec, buffer + header.header_length,
+            buffer_size - header.header_length, raw, raw_length);
+        if (payload_length == 0) {
+            buffer[4] = (uint8_t)picoquic_binlog_codec_none;
+            memcpy(buffer + header.header_length, raw, raw_length);
+            payload_length = raw_length;
+        }
+        picoformat_32(buffer, (uint32_t)(header.header_length + payload_length - 4));
+
+        if (fwrite(buffer, header.header_length + payload_length, 1, f) != 1) {
+            ret = -1;
+        }
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+int picoquic_binlog_block_parse(const uint8_t* bytes, size_t length, picoquic_binlog_block_header_t* header)
+{
+    int ret = 0;
+    bytestream stream;
+    bytestream* s = bytestream_ref_init(&stream, bytes, length);
+    uint32_t block_length = 0;
+    uint8_t codec = 0;
+    uint64_t raw_length = 0;
+    uint64_t nb_cids = 0;
+
+    memset(header, 0, sizeof(picoquic_binlog_block_header_t));
+
+    if (byteread_int32(s, &block_length) != 0 || (size_t)block_length > length - 4 ||
+        byteread_int8(s, &codec) != 0 || byteread_vint(s, &raw_length) != 0 ||
+        raw_length > PICOQUIC_BINLOG_BLOCK_RAW_MAX ||
+        byteread_vint(s, &header->first_time) != 0 || byteread_vint(s, &header->last_time) != 0 ||
+        byteread_vint(s, &nb_cids) != 0 || nb_cids > PICOQUIC_BINLOG_BLOCK_MAX_CIDS) {
+        ret = -1;
+    }
+    else {
+        header->block_length = 4 + (size_t)block_length;
+        header->codec = (picoquic_binlog_codec_enum)codec;
+        header->raw_length = (size_t)raw_length;
+        header->nb_cids = (size_t)nb_cids;
+        header->is_cid_list_overflow = (nb_cids == 0);
+        for (size_t i = 0; ret == 0 && i < header->nb_cids; i++) {
+            ret = byteread_cid(s, &header->cid[i]);
+        }
+        header->header_length = bytestream_length(s);
+        if (ret == 0 && header->header_length > header->block_length) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_binlog_block_has_cid(const picoquic_binlog_block_header_t* header, const picoquic_connection_id_t* cid)
+{
+    int ret = header->is_cid_list_overflow;
+
+    for (size_t i = 0; !ret && i < header->nb_cids; i++) {
+        ret = picoquic_compare_connection_id(cid, &header->cid[i]) == 0;
+    }
+
+    return ret;
+}
+
+int picoquic_binlog_block_decode(const picoquic_binlog_block_header_t* header, const uint8_t* block, uint8_t* raw)
+{
+    int ret = -1;
+    const uint8_t* payload = block + header->header_length;
+    size_t payload_length = header->block_length - header->header_length;
+
+    switch (header->codec) {
+    case picoquic_binlog_codec_none:
+        if (payload_length == header->raw_length) {
+            memcpy(raw, payload, payload_length);
+            ret = 0;
+        }
+        break;
+#ifdef PICOQUIC_WITH_ZSTD
+    case picoquic_binlog_codec_zstd: {
+        size_t dest_len = ZSTD_decompress(raw, header->raw_length, payload, payload_length);
+        if (!ZSTD_isError(dest_len) && dest_len == header->raw_length) {
+            ret = 0;
+        }
+        break;
+    }
+#endif
+#ifdef PICOQUIC_WITH_ZLIB
+    case picoquic_binlog_codec_zlib: {
+        uLongf dest_len = (uLongf)header->raw_length;
+        if (uncompress(raw, &dest_len, payload, (uLong)payload_length) == Z_OK && dest_len == header->raw_length) {
+            ret = 0;
+        }
+        break;
+    }
+#endif
+    default:
+        DBG_PRINTF("Binlog block compressed with unsupported codec %d", (int)header->codec);
+        break;
+    }
+
+    return ret;
+}
@@ -22,6 +22,7 @@
 #ifndef PICOQUIC_BYTESTREAM_H
 #define PICOQUIC_BYTESTREAM_H
 
+#include <string.h>
 #include "picoquic_internal.h"
 
 #ifdef __cplusplus
@@ -92,6 +93,86 @@ int bytewrite_addr(bytestream * s, const struct sockaddr * addr);
 int byteread_addr(bytestream * s, struct sockaddr_storage * addr);
 int byteskip_addr(bytestream * s);
 
+/*
+ * Inline encoders, for records whose maximum size is known in advance, such
+ * as binlog records written directly in the asynchronous log ring. There are
+ * no bounds checks: the caller reserves room for the maximum size of each
+ * field, and each function writes at "bytes" and returns the next position.
+ * The encoding is the same as that of the bytewrite functions, except that
+ * varints larger than 2^62 are truncated instead of failing.
+ */
+#define BYTEPUT_VINT_MAX 8
+#define BYTEPUT_CID_MAX (1 + PICOQUIC_CONNECTION_ID_MAX_SIZE)
+#define BYTEPUT_ADDR_MAX (BYTEPUT_VINT_MAX + 16 + 2)
+
+static inline uint8_t* byteput_int8(uint8_t* bytes, uint8_t value)
+{
+    *bytes = value;
+    return bytes + 1;
+}
+
+static inline uint8_t* byteput_int16(uint8_t* bytes, uint16_t value)
+{
+    bytes[0] = (uint8_t)(value >> 8);
+    bytes[1] = (uint8_t)value;
+    return bytes + 2;
+}
+
+static inline uint8_t* byteput_int32(uint8_t* bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t)(value >> 24);
+    bytes[1] = (uint8_t)(value >> 16);
+    bytes[2] = (uint8_t)(value >> 8);
+    bytes[3] = (uint8_t)value;
+    return bytes + 4;
+}
+
+static inline uint8_t* byteput_vint(uint8_t* bytes, uint64_t value)
+{
+    if (value < 0x40) {
+        bytes[0] = (uint8_t)value;
+        return bytes + 1;
+    }
+    else if (value < 0x4000) {
+        return byteput_int16(bytes, (uint16_t)(0x4000 | value));
+    }
+    else if (value < 0x40000000) {
+        return byteput_int32(bytes, (uint32_t)(0x80000000 | value));
+    }
+    else {
+        value = 0xC000000000000000ull | (value & 0x3FFFFFFFFFFFFFFFull);
+        (void)byteput_int32(bytes, (uint32_t)(value >> 32));
+        return byteput_int32(bytes + 4, (uint32_t)value);
+    }
+}
+
+static inline uint8_t* byteput_buffer(uint8_t* bytes, const void* buffer, size_t length)
+{
+    memcpy(bytes, buffer, length);
+    return bytes + length;
+}
+
+static inline uint8_t* byteput_cid(uint8_t* bytes, const picoquic_connection_id_t* cid)
+{
+    bytes[0] = cid->id_len;
+    return byteput_buffer(bytes + 1, cid->id, cid->id_len);
+}
+
+static inline uint8_t* byteput_addr(uint8_t* bytes, const struct sockaddr* addr)
+{
+    bytes = byteput_vint(bytes, addr->sa_family);
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* s4 = (const struct sockaddr_in*)addr;
+        bytes = byteput_buffer(bytes, &s4->sin_addr, 4);
+        return byteput_int16(bytes, s4->sin_port);
+    }
+    else {
+        const struct sockaddr_in6* s6 = (const struct sockaddr_in6*)addr;
+        bytes = byteput_buffer(bytes, &s6->sin6_addr, 16);
+        return byteput_int16(bytes, s6->sin6_port);
+    }
+}
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,280 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Careful Resume, as in draft-ietf-tsvwg-careful-resume.
+*
+* When a connection closes after leaving the startup phase, the context saves
+* the min RTT and the congestion window of its default path, indexed by the
+* peer address. A new connection to the same address is seeded with half the
+* saved window. The seed goes through the same checks as the session ticket
+* and BDP frame seeds (see picoquic_validate_bdp_seed): it is only applied
+* if the first RTT sample matches the saved RTT, which corresponds to the
+* "reconnaissance" phase of the draft. The congestion control algorithm then
+* jumps to the seeded window.
+*
+* The jump stays "unvalidated" until the seeded amount of data has been
+* delivered. If a loss is detected before that, the saved record is dropped,
+* so the next connection starts from a regular slow start, and the congestion
+* control algorithm handles the loss as usual. Connections that close while
+* unvalidated do not save their values.
+*
+* Records expire after a lifetime, and the least recently saved records are
+* evicted when the cache is full.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+#define PICOQUIC_CAREFUL_RESUME_LIFETIME (3600ull * 1000000ull)
+
+static uint64_t picoquic_resume_record_hash(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_resume_record_t* record = (const picoquic_resume_record_t*)key;
+
+    return picohash_siphash(record->ip_addr, record->ip_addr_length, hash_seed);
+}
+
+static int picoquic_resume_record_compare(const void* key1, const void* key2)
+{
+    const picoquic_resume_record_t* record1 = (const picoquic_resume_record_t*)key1;
+    const picoquic_resume_record_t* record2 = (const picoquic_resume_record_t*)key2;
+
+    return (record1->ip_addr_length == record2->ip_addr_length &&
+        memcmp(record1->ip_addr, record2->ip_addr, record1->ip_addr_length) == 0) ? 0 : 1;
+}
+
+static picohash_item* picoquic_resume_record_to_item(const void* key)
+{
+    picoquic_resume_record_t* record = (picoquic_resume_record_t*)key;
+
+    return &record->hash_item;
+}
+
+int picoquic_set_careful_resume(picoquic_quic_t* quic, size_t max_records, uint64_t lifetime)
+{
+    int ret = 0;
+
+    picoquic_careful_resume_free(quic);
+
+    if (max_records > 0) {
+        picoquic_careful_resume_t* careful_resume = (picoquic_careful_resume_t*)malloc(sizeof(picoquic_careful_resume_t));
+
+        if (careful_resume == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(careful_resume, 0, sizeof(picoquic_careful_resume_t));
+            careful_resume->max_records = max_records;
+            careful_resume->lifetime = (lifetime == 0) ? PICOQUIC_CAREFUL_RESUME_LIFETIME : lifetime;
+            careful_resume->table = picohash_create_ex(max_records, picoquic_resume_record_hash,
+                picoquic_resume_record_compare, picoquic_resume_record_to_item, quic->hash_seed);
+            if (careful_resume->table == NULL) {
+                free(careful_resume);
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                quic->careful_resume = careful_resume;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static void picoquic_resume_record_delete(picoquic_careful_resume_t* careful_resume, picoquic_resume_record_t* record)
+{
+    if (record->next_record == NULL) {
+        careful_resume->last = record->previous_record;
+    }
+    else {
+        record->next_record->previous_record = record->previous_record;
+    }
+
+    if (record->previous_record == NULL) {
+        careful_resume->first = record->next_record;
+    }
+    else {
+        record->previous_record->next_record = record->next_record;
+    }
+
+    picohash_delete_key(careful_resume->table, record, 1);
+
+    if (careful_resume->nb_records > 0) {
+        careful_resume->nb_records--;
+    }
+}
+
+void picoquic_careful_resume_free(picoquic_quic_t* quic)
+{
+    if (quic->careful_resume != NULL) {
+        while (quic->careful_resume->first != NULL) {
+            picoquic_resume_record_delete(quic->careful_resume, quic->careful_resume->first);
+        }
+        picohash_delete(quic->careful_resume->table, 1);
+        free(quic->careful_resume);
+        quic->careful_resume = NULL;
+    }
+}
+
+picoquic_resume_record_t* picoquic_careful_resume_find(picoquic_quic_t* quic,
+    const uint8_t* ip_addr, uint8_t ip_addr_length, uint64_t current_time)
+{
+    picoquic_resume_record_t* record = NULL;
+
+    if (quic->careful_resume != NULL && ip_addr_length <= PICOQUIC_STORED_IP_MAX) {
+        picoquic_resume_record_t key;
+        picohash_item* item;
+
+        memset(&key, 0, sizeof(key));
+        memcpy(key.ip_addr, ip_addr, ip_addr_length);
+        key.ip_addr_length = ip_addr_length;
+
+        item = picohash_retrieve(quic->careful_resume->table, &key);
+        if (item != NULL) {
+            record = (picoquic_resume_record_t*)item->key;
+            if (record->saved_time + quic->careful_resume->lifetime <= current_time) {
+                picoquic_resume_record_delete(quic->careful_resume, record);
+                record = NULL;
+            }
+        }
+    }
+
+    return record;
+}
+
+static void picoquic_careful_resume_peer_addr(picoquic_path_t* path_x, uint8_t** ip_addr, uint8_t* ip_addr_length)
+{
+    picoquic_get_ip_addr((struct sockaddr*)&path_x->first_tuple->peer_addr, ip_addr, ip_addr_length);
+}
+
+/* Called when the connection is created. Values obtained from a session
+ * ticket later in the handshake replace the careful resume seed. */
+void picoquic_careful_resume_seed(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    if (cnx->quic->careful_resume != NULL && cnx->path != NULL && cnx->nb_paths > 0 && cnx->seed_cwin == 0) {
+        uint8_t* ip_addr;
+        uint8_t ip_addr_length;
+        picoquic_resume_record_t* record;
+
+        picoquic_careful_resume_peer_addr(cnx->path[0], &ip_addr, &ip_addr_length);
+        record = picoquic_careful_resume_find(cnx->quic, ip_addr, ip_addr_length, current_time);
+        if (record != NULL) {
+            picoquic_seed_bandwidth(cnx, record->rtt_min, record->cwin / 2, record->ip_addr, record->ip_addr_length);
+            cnx->is_careful_resume_seeded = 1;
+        }
+    }
+}
+
+/* Called when the seed was passed to the congestion control algorithm */
+void picoquic_careful_resume_jump(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    if (cnx->is_careful_resume_seeded && cnx->quic->careful_resume != NULL) {
+        cnx->is_careful_resume_unvalidated = 1;
+        cnx->careful_resume_delivered = path_x->delivered;
+        cnx->careful_resume_losses = path_x->nb_losses_found;
+        cnx->quic->careful_resume->nb_jumps++;
+    }
+}
+
+/* Called on each RTT sample while the jump is not validated */
+void picoquic_careful_resume_monitor(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    if (cnx->is_careful_resume_unvalidated && path_x == cnx->path[0]) {
+        if (path_x->nb_losses_found > cnx->careful_resume_losses) {
+            /* Safe retreat: forget the saved values */
+            cnx->is_careful_resume_unvalidated = 0;
+            if (cnx->quic->careful_resume != NULL) {
+                picoquic_resume_record_t* record = picoquic_careful_resume_find(cnx->quic,
+                    cnx->seed_ip_addr, cnx->seed_ip_addr_length, 0);
+                if (record != NULL) {
+                    picoquic_resume_record_delete(cnx->quic->careful_resume, record);
+                }
+                cnx->quic->careful_resume->nb_retreats++;
+            }
+        }
+        else if (path_x->delivered - cnx->careful_resume_delivered >= cnx->seed_cwin) {
+            cnx->is_careful_resume_unvalidated = 0;
+        }
+    }
+}
+
+/* Called when the connection is deleted */
+void picoquic_careful_resume_save(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_careful_resume_t* careful_resume = cnx->quic->careful_resume;
+    picoquic_path_t* path_x = (cnx->path == NULL || cnx->nb_paths <= 0) ? NULL : cnx->path[0];
+
+    if (careful_resume != NULL && path_x != NULL && path_x->first_tuple != NULL &&
+        path_x->is_ssthresh_initialized && path_x->rtt_min > 0 &&
+        !cnx->is_careful_resume_unvalidated) {
+        uint64_t target_cwin = path_x->cwin;
+        uint8_t* ip_addr;
+        uint8_t ip_addr_length;
+
+        if (path_x->bandwidth_estimate_max > 0) {
+            target_cwin = (path_x->bandwidth_estimate_max * path_x->rtt_min) / 1000000ull;
+        }
+        picoquic_careful_resume_peer_addr(path_x, &ip_addr, &ip_addr_length);
+
+        if (target_cwin > PICOQUIC_CWIN_INITIAL && ip_addr != NULL && ip_addr_length <= PICOQUIC_STORED_IP_MAX) {
+            picoquic_resume_record_t* record = picoquic_careful_resume_find(cnx->quic, ip_addr, ip_addr_length, current_time);
+
+            if (record != NULL) {
+                picoquic_resume_record_delete(careful_resume, record);
+            }
+            while (careful_resume->nb_records >= careful_resume->max_records && careful_resume->last != NULL) {
+                picoquic_resume_record_delete(careful_resume, careful_resume->last);
+            }
+            record = (picoquic_resume_record_t*)malloc(sizeof(picoquic_resume_record_t));
+            if (record != NULL) {
+                memset(record, 0, sizeof(picoquic_resume_record_t));
+                memcpy(record->ip_addr, ip_addr, ip_addr_length);
+                record->ip_addr_length = ip_addr_length;
+                record->saved_time = current_time;
+                record->rtt_min = path_x->rtt_min;
+                record->cwin = target_cwin;
+                record->next_record = careful_resume->first;
+                if (record->next_record == NULL) {
+                    careful_resume->last = record;
+                }
+                else {
+                    record->next_record->previous_record = record;
+                }
+                careful_resume->first = record;
+                if (picohash_insert(careful_resume->table, record) == 0) {
+                    careful_resume->nb_records++;
+                }
+                else {
+                    careful_resume->first = record->next_record;
+                    if (careful_resume->first == NULL) {
+                        careful_resume->last = NULL;
+                    }
+                    else {
+                        careful_resume->first->previous_record = NULL;
+                    }
+                    free(record);
+                }
+            }
+        }
+    }
+}
@@ -191,6 +191,117 @@ int picoquic_cc_hystart_test(picoquic_min_max_rtt_t* rtt_track, uint64_t rtt_mea
     return ret;
 }
 
+/* HyStart++, RFC 9406.
+ * The algorithms call picoquic_hystart_pp_test on each RTT measurement while
+ * in initial slow start, and leave slow start when it returns 1. In between,
+ * the window increase is divided by CSS_GROWTH_DIVISOR during the CSS phase.
+ */
+void picoquic_hystart_pp_reset(picoquic_hystart_pp_t* hspp, picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    memset(hspp, 0, sizeof(picoquic_hystart_pp_t));
+    hspp->phase = picoquic_hystart_pp_slow_start;
+    hspp->is_enabled = cnx->quic->is_hystart_pp_enabled;
+    hspp->window_end = picoquic_cc_get_sequence_number(cnx, path_x);
+    hspp->last_round_min_rtt = UINT64_MAX;
+    hspp->current_round_min_rtt = UINT64_MAX;
+    hspp->css_baseline_min_rtt = UINT64_MAX;
+}
+
+int picoquic_hystart_pp_test(picoquic_hystart_pp_t* hspp, picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t rtt_measurement)
+{
+    int ret = 0;
+    uint64_t highest_acknowledged = picoquic_cc_get_ack_number(cnx, path_x);
+
+    if (hspp->phase != picoquic_hystart_pp_done &&
+        highest_acknowledged != UINT64_MAX && highest_acknowledged >= hspp->window_end) {
+        /* The round ends, start the next one with the packets in flight. */
+        hspp->last_round_min_rtt = hspp->current_round_min_rtt;
+        hspp->current_round_min_rtt = UINT64_MAX;
+        hspp->rtt_sample_count = 0;
+        hspp->window_end = picoquic_cc_get_sequence_number(cnx, path_x);
+        if (hspp->phase == picoquic_hystart_pp_css) {
+            hspp->css_rounds++;
+            if (hspp->css_rounds >= PICOQUIC_HYSTART_PP_CSS_ROUNDS) {
+                /* The RTT increase was confirmed, exit slow start. */
+                hspp->phase = picoquic_hystart_pp_done;
+                ret = 1;
+            }
+        }
+    }
+
+    if (ret == 0 && hspp->phase != picoquic_hystart_pp_done) {
+        if (rtt_measurement < hspp->current_round_min_rtt) {
+            hspp->current_round_min_rtt = rtt_measurement;
+        }
+        hspp->rtt_sample_count++;
+
+        if (hspp->rtt_sample_count >= PICOQUIC_HYSTART_PP_N_RTT_SAMPLE) {
+            if (hspp->phase == picoquic_hystart_pp_slow_start) {
+                if (hspp->last_round_min_rtt != UINT64_MAX) {
+                    uint64_t rtt_thresh = hspp->last_round_min_rtt / PICOQUIC_HYSTART_PP_MIN_RTT_DIVISOR;
+                    if (rtt_thresh < PICOQUIC_HYSTART_PP_MIN_RTT_THRESH) {
+                        rtt_thresh = PICOQUIC_HYSTART_PP_MIN_RTT_THRESH;
+                    }
+                    else if (rtt_thresh > PICOQUIC_HYSTART_PP_MAX_RTT_THRESH) {
+                        rtt_thresh = PICOQUIC_HYSTART_PP_MAX_RTT_THRESH;
+                    }
+                    if (hspp->current_round_min_rtt >= hspp->last_round_min_rtt + rtt_thresh) {
+                        hspp->phase = picoquic_hystart_pp_css;
+                        hspp->css_baseline_min_rtt = hspp->current_round_min_rtt;
+                        hspp->css_rounds = 0;
+                    }
+                }
+            }
+            else if (hspp->current_round_min_rtt < hspp->css_baseline_min_rtt) {
+                /* The RTT increase was spurious, resume slow start. */
+                hspp->phase = picoquic_hystart_pp_slow_start;
+                hspp->css_baseline_min_rtt = UINT64_MAX;
+            }
+        }
+    }
+
+    return ret;
+}
+
+uint64_t picoquic_hystart_pp_increase(picoquic_hystart_pp_t* hspp, picoquic_path_t* path_x, uint64_t nb_delivered)
+{
+    return picoquic_cc_slow_start_increase_ex(path_x, nb_delivered, picoquic_hystart_pp_in_css(hspp));
+}
+
+/* Record the first exit from the initial slow start, for the telemetry.
+ * The reason is derived from the notification that caused the exit. An exit
+ * on acknowledgement comes from the ECN marks counted in the ACK, as done
+ * by Prague. HyStart++ does not apply after the initial slow start. */
+void picoquic_cc_record_slow_start_exit(picoquic_path_t* path_x, picoquic_hystart_pp_t* hspp,
+    picoquic_congestion_notification_t notification, uint64_t current_time)
+{
+    if (path_x->slow_start_exit_reason == picoquic_slow_start_exit_none) {
+        switch (notification) {
+        case picoquic_congestion_notification_ecn_ec:
+        case picoquic_congestion_notification_acknowledgement:
+            path_x->slow_start_exit_reason = picoquic_slow_start_exit_ecn;
+            break;
+        case picoquic_congestion_notification_timeout:
+            path_x->slow_start_exit_reason = picoquic_slow_start_exit_timeout;
+            break;
+        case picoquic_congestion_notification_rtt_measurement:
+            path_x->slow_start_exit_reason = (hspp != NULL && hspp->is_enabled) ?
+                picoquic_slow_start_exit_css : picoquic_slow_start_exit_rtt;
+            break;
+        case picoquic_congestion_notification_seed_cwin:
+            path_x->slow_start_exit_reason = picoquic_slow_start_exit_ssthresh;
+            break;
+        default:
+            path_x->slow_start_exit_reason = picoquic_slow_start_exit_loss;
+            break;
+        }
+        path_x->slow_start_exit_time = current_time;
+    }
+    if (hspp != NULL) {
+        hspp->phase = picoquic_hystart_pp_done;
+    }
+}
+
 uint64_t picoquic_cc_slow_start_increase(picoquic_path_t * path_x, uint64_t nb_delivered) {
     /* App limited. */
     /* TODO discuss
@@ -285,4 +396,177 @@ uint64_t picoquic_cc_increased_window(picoquic_cnx_t* cnx, uint64_t previous_win
         new_window = (uint64_t)w;
     }
     return new_window;
-}
\ No newline at end of file
+}
+/* Congestion control snapshots.
+ * A snapshot is a sequence of varints: the format version, the algorithm
+ * number, the path values, and then the values exported by the algorithm.
+ * The path values are the RTT estimates, the congestion window and the
+ * bandwidth estimates. They are restored before calling the algorithm, so
+ * the import function of the algorithm can rely on them. Bytes after the
+ * algorithm values are ignored, so later versions can append values.
+ */
+#define PICOQUIC_CC_SNAPSHOT_VERSION 1
+#define PICOQUIC_CC_SNAPSHOT_NB_PATH_VALUES 8
+
+uint8_t* picoquic_cc_snapshot_encode(uint8_t* bytes, const uint8_t* bytes_max, const uint64_t* values, size_t nb_values)
+{
+    for (size_t i = 0; bytes != NULL && i < nb_values; i++) {
+        uint64_t v = (values[i] > PICOQUIC_CC_SNAPSHOT_VARINT_MAX) ? PICOQUIC_CC_SNAPSHOT_VARINT_MAX : values[i];
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, v);
+    }
+    return bytes;
+}
+
+const uint8_t* picoquic_cc_snapshot_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* values, size_t nb_values)
+{
+    if ((bytes = picoquic_frames_varint_decode_batch(bytes, bytes_max, values, nb_values)) != NULL) {
+        for (size_t i = 0; i < nb_values; i++) {
+            if (values[i] == PICOQUIC_CC_SNAPSHOT_VARINT_MAX) {
+                values[i] = UINT64_MAX;
+            }
+        }
+    }
+    return bytes;
+}
+
+uint64_t picoquic_cc_snapshot_age(uint64_t stamp, uint64_t current_time)
+{
+    return (current_time > stamp) ? current_time - stamp : 0;
+}
+
+uint64_t picoquic_cc_snapshot_stamp(uint64_t age, uint64_t current_time)
+{
+    return (current_time > age) ? current_time - age : 0;
+}
+
+/* Multiply a value by a Q16 gain. The value is split in high and low parts
+ * so the products do not overflow for values below 2^48 and gains below 2^16,
+ * which covers any realistic window or BDP.
+ */
+uint64_t picoquic_cc_apply_gain_q16(uint64_t value, uint64_t gain_q16)
+{
+    return (value >> 16) * gain_q16 + (((value & 0xFFFF) * gain_q16) >> 16);
+}
+
+/* Integer cube root, rounded down, computed one bit of the result at a time
+ * using the binary long hand method. */
+uint64_t picoquic_cc_cube_root(uint64_t x)
+{
+    uint64_t y = 0;
+
+    for (int s = 63; s >= 0; s -= 3) {
+        uint64_t b;
+        y += y;
+        b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+
+    return y;
+}
+
+static void picoquic_cc_snapshot_get_path(picoquic_path_t* path_x, uint64_t* values)
+{
+    values[0] = path_x->rtt_min;
+    values[1] = path_x->smoothed_rtt;
+    values[2] = path_x->rtt_variant;
+    values[3] = path_x->cwin;
+    values[4] = path_x->bandwidth_estimate;
+    values[5] = path_x->bandwidth_estimate_max;
+    values[6] = path_x->peak_bandwidth_estimate;
+    values[7] = path_x->is_ssthresh_initialized;
+}
+
+static void picoquic_cc_snapshot_set_path(picoquic_path_t* path_x, const uint64_t* values)
+{
+    path_x->rtt_min = values[0];
+    path_x->smoothed_rtt = values[1];
+    path_x->rtt_variant = values[2];
+    path_x->cwin = values[3];
+    path_x->bandwidth_estimate = values[4];
+    path_x->bandwidth_estimate_max = values[5];
+    path_x->peak_bandwidth_estimate = values[6];
+    path_x->is_ssthresh_initialized = (values[7] != 0);
+}
+
+int picoquic_export_path_cc_state(picoquic_cnx_t* cnx, uint64_t unique_path_id,
+    uint8_t* bytes, size_t bytes_max, size_t* length, uint64_t current_time)
+{
+    int ret = 0;
+    int path_id = picoquic_get_path_id_from_unique(cnx, unique_path_id);
+
+    *length = 0;
+    if (path_id < 0) {
+        ret = PICOQUIC_ERROR_PATH_ID_INVALID;
+    }
+    else if (cnx->congestion_alg == NULL || cnx->congestion_alg->alg_export == NULL ||
+        cnx->path[path_id]->congestion_alg_state == NULL) {
+        ret = PICOQUIC_ERROR_CC_SNAPSHOT_MISMATCH;
+    }
+    else {
+        picoquic_path_t* path_x = cnx->path[path_id];
+        uint8_t* bytes_end = bytes + bytes_max;
+        uint64_t header[2 + PICOQUIC_CC_SNAPSHOT_NB_PATH_VALUES];
+        uint8_t* bytes_next;
+
+        header[0] = PICOQUIC_CC_SNAPSHOT_VERSION;
+        header[1] = cnx->congestion_alg->congestion_algorithm_number;
+        picoquic_cc_snapshot_get_path(path_x, header + 2);
+        bytes_next = picoquic_cc_snapshot_encode(bytes, bytes_end, header, 2 + PICOQUIC_CC_SNAPSHOT_NB_PATH_VALUES);
+
+        if (bytes_next != NULL) {
+            bytes_next = cnx->congestion_alg->alg_export(path_x, bytes_next, bytes_end, current_time);
+        }
+        if (bytes_next == NULL) {
+            ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+        }
+        else {
+            *length = (size_t)(bytes_next - bytes);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_import_path_cc_state(picoquic_cnx_t* cnx, uint64_t unique_path_id,
+    const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+    int path_id = picoquic_get_path_id_from_unique(cnx, unique_path_id);
+    const uint8_t* bytes_end = bytes + length;
+    uint64_t header[2 + PICOQUIC_CC_SNAPSHOT_NB_PATH_VALUES];
+
+    if (path_id < 0) {
+        ret = PICOQUIC_ERROR_PATH_ID_INVALID;
+    }
+    else if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_end, header, 2 + PICOQUIC_CC_SNAPSHOT_NB_PATH_VALUES)) == NULL ||
+        header[0] != PICOQUIC_CC_SNAPSHOT_VERSION || header[2] == 0 || header[3] == 0 || header[5] == 0) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else if (cnx->congestion_alg == NULL || cnx->congestion_alg->alg_import == NULL ||
+        cnx->congestion_alg->congestion_algorithm_number != header[1] ||
+        cnx->path[path_id]->congestion_alg_state == NULL) {
+        ret = PICOQUIC_ERROR_CC_SNAPSHOT_MISMATCH;
+    }
+    else {
+        picoquic_path_t* path_x = cnx->path[path_id];
+        uint64_t saved[PICOQUIC_CC_SNAPSHOT_NB_PATH_VALUES];
+        uint64_t saved_retransmit_timer = path_x->retransmit_timer;
+
+        picoquic_cc_snapshot_get_path(path_x, saved);
+        picoquic_cc_snapshot_set_path(path_x, header + 2);
+        path_x->retransmit_timer = path_x->smoothed_rtt + 3 * path_x->rtt_variant +
+            cnx->remote_parameters.max_ack_delay;
+
+        /* The algorithm does not modify its state if the import fails. */
+        if (cnx->congestion_alg->alg_import(cnx, path_x, bytes, bytes_end, current_time) == NULL) {
+            picoquic_cc_snapshot_set_path(path_x, saved);
+            path_x->retransmit_timer = saved_retransmit_timer;
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+
+    return ret;
+}
@@ -35,7 +35,6 @@ extern "C" {
  * HyStart++
  */
 
-/* TODO HyStart++ isn't implemented yet! */
 /* It is RECOMMENDED that a HyStart++ implementation use the following constants: */
 /* MIN_RTT_THRESH = 4 msec
  * MAX_RTT_THRESH = 16 msec
@@ -58,6 +57,40 @@ extern "C" {
  */
 /* #define PICOQUIC_HYSTART_PP_L UINT64_MAX */ /* infinity if paced, L = 8 if non-paced */
 
+/* HyStart++ state, shared by the algorithms that use it. Rounds start when
+ * a packet is sent and end when it is acknowledged, as in the RFC; the
+ * minimum RTT of the round is compared to that of the previous round once
+ * N_RTT_SAMPLE samples are collected. An increase beyond the threshold moves
+ * from slow start to CSS. CSS ends with "done" after CSS_ROUNDS rounds, or
+ * goes back to slow start if the RTT falls below the CSS baseline.
+ */
+typedef enum {
+    picoquic_hystart_pp_slow_start = 0,
+    picoquic_hystart_pp_css,
+    picoquic_hystart_pp_done
+} picoquic_hystart_pp_phase_t;
+
+typedef struct st_picoquic_hystart_pp_t {
+    picoquic_hystart_pp_phase_t phase;
+    int is_enabled;
+    uint64_t window_end;
+    uint64_t last_round_min_rtt;
+    uint64_t current_round_min_rtt;
+    uint64_t css_baseline_min_rtt;
+    uint64_t rtt_sample_count;
+    uint64_t css_rounds;
+} picoquic_hystart_pp_t;
+
+void picoquic_hystart_pp_reset(picoquic_hystart_pp_t* hspp, picoquic_cnx_t* cnx, picoquic_path_t* path_x);
+int picoquic_hystart_pp_test(picoquic_hystart_pp_t* hspp, picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t rtt_measurement);
+uint64_t picoquic_hystart_pp_increase(picoquic_hystart_pp_t* hspp, picoquic_path_t* path_x, uint64_t nb_delivered);
+#define picoquic_hystart_pp_in_css(hspp) ((hspp)->phase == picoquic_hystart_pp_css)
+
+/* Record the first exit from the initial slow start on the path, for the telemetry.
+ * The HyStart++ state is optional, it qualifies exits on RTT measurements. */
+void picoquic_cc_record_slow_start_exit(picoquic_path_t* path_x, picoquic_hystart_pp_t* hspp,
+    picoquic_congestion_notification_t notification, uint64_t current_time);
+
 typedef struct st_picoquic_min_max_rtt_t {
     uint64_t last_rtt_sample_time;
     uint64_t rtt_filtered_min;
@@ -107,6 +140,25 @@ uint64_t picoquic_cc_update_target_cwin_estimation(picoquic_path_t* path_x);
  */
 uint64_t picoquic_cc_update_cwin_for_long_rtt(picoquic_path_t * path_x);
 
+/* Helpers for congestion control snapshots. Values are encoded as varints,
+ * values too large for a varint (e.g., UINT64_MAX markers) saturate and are
+ * decoded as UINT64_MAX. Time stamps are exported as ages.
+ */
+uint8_t* picoquic_cc_snapshot_encode(uint8_t* bytes, const uint8_t* bytes_max, const uint64_t* values, size_t nb_values);
+const uint8_t* picoquic_cc_snapshot_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* values, size_t nb_values);
+uint64_t picoquic_cc_snapshot_age(uint64_t stamp, uint64_t current_time);
+uint64_t picoquic_cc_snapshot_stamp(uint64_t age, uint64_t current_time);
+#define PICOQUIC_CC_SNAPSHOT_VARINT_MAX 0x3FFFFFFFFFFFFFFFull
+
+/* Fixed point helpers for the per-ACK computations. Gains are expressed in
+ * Q16 format, i.e., as integers scaled by 2^16, so that applying a gain to
+ * a number of bytes only requires integer multiplications and shifts.
+ */
+#define PICOQUIC_CC_Q16_ONE 0x10000ull
+#define PICOQUIC_CC_Q16(x) ((uint64_t)((x) * 65536.0 + 0.5))
+uint64_t picoquic_cc_apply_gain_q16(uint64_t value, uint64_t gain_q16);
+uint64_t picoquic_cc_cube_root(uint64_t x);
+
 /* Many congestion control algorithms run a parallel version of new reno in order
  * to provide a lower bound estimate of either the congestion window or the
  * the minimal bandwidth. This implementation of new reno does not directly
@@ -0,0 +1,356 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Congestion manager, in the spirit of RFC 3124.
+*
+* When several connections reach the same peer, each of them runs its own
+* congestion control, and together they push several times the capacity of
+* the bottleneck. The congestion manager puts the paths that reach the same
+* peer address or address prefix in a group. The congestion control of each
+* path keeps running, but transmissions are also checked against the group:
+*
+* - The aggregate window is the largest window computed by the members,
+*   which is the best estimate of the bottleneck capacity. Each path is
+*   guaranteed a share of that window in proportion to the weight of its
+*   connection. It may use more than its share if the aggregate bytes in
+*   transit stay below the aggregate window, so that an idle member does not
+*   waste capacity.
+* - The group has its own pacing bucket, refilled at the highest pacing rate
+*   of the members and drained by the packets of all members.
+*
+* A path that is under its share is never blocked by the aggregate window,
+* so it always has packets in transit and will be woken by their ACKs; paths
+* blocked by the group pacing are woken at the pacing time. There is thus no
+* need to wake the other members when a path receives ACKs.
+*
+* A new connection that joins a group in which some member already has RTT
+* measurements starts from the RTT of that member and is seeded with its
+* share of the aggregate window. The seed goes through the same validation
+* as the session ticket and careful resume seeds (picoquic_validate_bdp_seed),
+* after which the congestion control skips the slow start.
+*
+* Paths join the group of their peer address when they are created, and
+* leave it when they are deleted. Paths that migrate to a new peer address
+* stay in their original group.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+static uint64_t picoquic_cc_group_hash(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_cc_group_t* group = (const picoquic_cc_group_t*)key;
+
+    return picohash_siphash(group->prefix, group->prefix_length, hash_seed);
+}
+
+static int picoquic_cc_group_compare(const void* key1, const void* key2)
+{
+    const picoquic_cc_group_t* group1 = (const picoquic_cc_group_t*)key1;
+    const picoquic_cc_group_t* group2 = (const picoquic_cc_group_t*)key2;
+
+    return (group1->prefix_length == group2->prefix_length &&
+        memcmp(group1->prefix, group2->prefix, group1->prefix_length) == 0) ? 0 : 1;
+}
+
+static picohash_item* picoquic_cc_group_to_item(const void* key)
+{
+    picoquic_cc_group_t* group = (picoquic_cc_group_t*)key;
+
+    return &group->hash_item;
+}
+
+int picoquic_set_congestion_manager(picoquic_quic_t* quic, int enable, uint8_t ipv4_prefix_bits, uint8_t ipv6_prefix_bits)
+{
+    int ret = 0;
+
+    if (!enable) {
+        picoquic_cc_manager_free(quic);
+    }
+    else {
+        if (quic->cc_manager == NULL) {
+            picoquic_cc_manager_t* cc_manager = (picoquic_cc_manager_t*)malloc(sizeof(picoquic_cc_manager_t));
+
+            if (cc_manager == NULL) {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                memset(cc_manager, 0, sizeof(picoquic_cc_manager_t));
+                cc_manager->table = picohash_create_ex(64, picoquic_cc_group_hash,
+                    picoquic_cc_group_compare, picoquic_cc_group_to_item, quic->hash_seed);
+                if (cc_manager->table == NULL) {
+                    free(cc_manager);
+                    ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    quic->cc_manager = cc_manager;
+                }
+            }
+        }
+        if (ret == 0) {
+            /* The prefixes only apply to paths created after this call */
+            quic->cc_manager->ipv4_prefix_bits = (ipv4_prefix_bits == 0 || ipv4_prefix_bits > 32) ? 32 : ipv4_prefix_bits;
+            quic->cc_manager->ipv6_prefix_bits = (ipv6_prefix_bits == 0 || ipv6_prefix_bits > 128) ? 128 : ipv6_prefix_bits;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_set_congestion_manager_weight(picoquic_cnx_t* cnx, uint32_t weight)
+{
+    cnx->cc_manager_weight = weight;
+}
+
+int picoquic_get_congestion_manager_stats(picoquic_quic_t* quic, picoquic_congestion_manager_stats_t* stats)
+{
+    int ret = -1;
+
+    if (quic->cc_manager != NULL) {
+        *stats = quic->cc_manager->stats;
+        ret = 0;
+    }
+
+    return ret;
+}
+
+static uint64_t picoquic_cc_manager_weight(picoquic_cnx_t* cnx)
+{
+    return (cnx->cc_manager_weight == 0) ? 1 : cnx->cc_manager_weight;
+}
+
+void picoquic_cc_manager_free(picoquic_quic_t* quic)
+{
+    if (quic->cc_manager != NULL) {
+        picoquic_cnx_t* cnx = quic->cnx_list;
+
+        while (cnx != NULL) {
+            for (int i = 0; i < cnx->nb_paths; i++) {
+                picoquic_cc_manager_leave(cnx->path[i]);
+            }
+            cnx = cnx->next_in_table;
+        }
+        picohash_delete(quic->cc_manager->table, 1);
+        free(quic->cc_manager);
+        quic->cc_manager = NULL;
+    }
+}
+
+void picoquic_cc_manager_join(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time)
+{
+    picoquic_cc_manager_t* cc_manager = cnx->quic->cc_manager;
+
+    if (cc_manager != NULL && path_x->cc_group == NULL && path_x->first_tuple != NULL &&
+        path_x->first_tuple->peer_addr.ss_family != 0) {
+        picoquic_cc_group_t key;
+        picoquic_cc_group_t* group = NULL;
+        picohash_item* item;
+        uint8_t* ip_addr;
+        uint8_t ip_addr_length;
+        uint8_t prefix_bits;
+
+        picoquic_get_ip_addr((struct sockaddr*)&path_x->first_tuple->peer_addr, &ip_addr, &ip_addr_length);
+        prefix_bits = (ip_addr_length == 4) ? cc_manager->ipv4_prefix_bits : cc_manager->ipv6_prefix_bits;
+        if (prefix_bits > 8 * ip_addr_length) {
+            prefix_bits = 8 * ip_addr_length;
+        }
+
+        /* The key is the address, with the bits after the prefix set to zero */
+        memset(&key, 0, sizeof(key));
+        key.prefix_length = ip_addr_length;
+        memcpy(key.prefix, ip_addr, prefix_bits / 8);
+        if ((prefix_bits & 7) != 0) {
+            key.prefix[prefix_bits / 8] = ip_addr[prefix_bits / 8] & (uint8_t)(0xFF << (8 - (prefix_bits & 7)));
+        }
+
+        if (ip_addr_length == 0 || ip_addr_length > PICOQUIC_STORED_IP_MAX) {
+            /* Not an IP address */
+        }
+        else if ((item = picohash_retrieve(cc_manager->table, &key)) != NULL) {
+            group = (picoquic_cc_group_t*)item->key;
+        }
+        else {
+            group = (picoquic_cc_group_t*)malloc(sizeof(picoquic_cc_group_t));
+            if (group != NULL) {
+                memcpy(group, &key, sizeof(key));
+                picoquic_pacing_init(&group->pacing, current_time);
+                if (picohash_insert(cc_manager->table, group) != 0) {
+                    free(group);
+                    group = NULL;
+                }
+                else {
+                    cc_manager->stats.nb_groups++;
+                }
+            }
+        }
+
+        if (group != NULL) {
+            path_x->cc_group = group;
+            path_x->cc_group_previous = NULL;
+            path_x->cc_group_next = group->first_member;
+            if (group->first_member != NULL) {
+                group->first_member->cc_group_previous = path_x;
+            }
+            group->first_member = path_x;
+            group->nb_members++;
+            if (group->nb_members > 1) {
+                cc_manager->stats.nb_joined++;
+            }
+        }
+    }
+}
+
+void picoquic_cc_manager_leave(picoquic_path_t* path_x)
+{
+    picoquic_cc_group_t* group = path_x->cc_group;
+
+    if (group != NULL) {
+        if (path_x->cc_group_previous == NULL) {
+            group->first_member = path_x->cc_group_next;
+        }
+        else {
+            path_x->cc_group_previous->cc_group_next = path_x->cc_group_next;
+        }
+        if (path_x->cc_group_next != NULL) {
+            path_x->cc_group_next->cc_group_previous = path_x->cc_group_previous;
+        }
+        path_x->cc_group = NULL;
+        path_x->cc_group_next = NULL;
+        path_x->cc_group_previous = NULL;
+        group->nb_members--;
+
+        if (group->nb_members <= 0) {
+            picoquic_cc_manager_t* cc_manager = path_x->cnx->quic->cc_manager;
+
+            picohash_delete_key(cc_manager->table, group, 1);
+            cc_manager->stats.nb_groups--;
+        }
+    }
+}
+
+/* Called when the connection is created, before the careful resume seed. */
+void picoquic_cc_manager_seed(picoquic_cnx_t* cnx)
+{
+    picoquic_path_t* path_x = (cnx->path == NULL || cnx->nb_paths <= 0) ? NULL : cnx->path[0];
+    picoquic_cc_group_t* group = (path_x == NULL) ? NULL : path_x->cc_group;
+
+    if (group != NULL && group->nb_members > 1 && cnx->seed_cwin == 0) {
+        picoquic_path_t* member = group->first_member;
+        picoquic_path_t* best = NULL;
+        uint64_t total_weight = 0;
+
+        while (member != NULL) {
+            total_weight += picoquic_cc_manager_weight(member->cnx);
+            if (member != path_x && member->rtt_is_initialized &&
+                (best == NULL || member->cwin > best->cwin)) {
+                best = member;
+            }
+            member = member->cc_group_next;
+        }
+
+        if (best != NULL) {
+            uint64_t share = (uint64_t)(((double)best->cwin * (double)picoquic_cc_manager_weight(cnx)) /
+                (double)total_weight);
+
+            path_x->smoothed_rtt = best->smoothed_rtt;
+            path_x->rtt_variant = best->rtt_variant;
+            path_x->retransmit_timer = best->retransmit_timer;
+            if (share > PICOQUIC_CWIN_INITIAL) {
+                uint8_t* ip_addr;
+                uint8_t ip_addr_length;
+
+                picoquic_get_ip_addr((struct sockaddr*)&path_x->first_tuple->peer_addr, &ip_addr, &ip_addr_length);
+                picoquic_seed_bandwidth(cnx, best->rtt_min, share, ip_addr, ip_addr_length);
+            }
+            cnx->quic->cc_manager->stats.nb_seeded++;
+        }
+    }
+}
+
+/* Check whether the group lets the path send a packet that is subject to
+ * congestion control. If the group pacing blocks the transmission, the
+ * next time is set to the time at which the bucket will be refilled. */
+int picoquic_cc_manager_is_blocked(picoquic_path_t* path_x, uint64_t current_time, uint64_t* next_time)
+{
+    int is_blocked = 0;
+    picoquic_cc_group_t* group = path_x->cc_group;
+
+    if (group != NULL && group->nb_members > 1) {
+        picoquic_path_t* member = group->first_member;
+        uint64_t cwin = 0;
+        uint64_t bytes_in_transit = 0;
+        uint64_t total_weight = 0;
+        uint64_t pacing_rate = 0;
+        uint64_t smoothed_rtt = PICOQUIC_INITIAL_RTT;
+        uint64_t share;
+
+        while (member != NULL) {
+            bytes_in_transit += member->bytes_in_transit;
+            total_weight += picoquic_cc_manager_weight(member->cnx);
+            if (member->cwin > cwin) {
+                cwin = member->cwin;
+                smoothed_rtt = member->smoothed_rtt;
+            }
+            if (member->pacing.rate > pacing_rate) {
+                pacing_rate = member->pacing.rate;
+            }
+            member = member->cc_group_next;
+        }
+        share = (uint64_t)(((double)cwin * (double)picoquic_cc_manager_weight(path_x->cnx)) / (double)total_weight);
+
+        if (path_x->bytes_in_transit >= share && bytes_in_transit >= cwin) {
+            is_blocked = 1;
+        }
+        else if (pacing_rate > 0) {
+            if (pacing_rate != group->pacing.rate || cwin != group->cwin) {
+                uint64_t quantum = cwin / 4;
+
+                if (quantum > 16ull * path_x->send_mtu) {
+                    quantum = 16ull * path_x->send_mtu;
+                }
+                if (quantum < 2ull * path_x->send_mtu) {
+                    quantum = 2ull * path_x->send_mtu;
+                }
+                picoquic_update_pacing_parameters(&group->pacing, (double)pacing_rate, quantum,
+                    path_x->send_mtu, smoothed_rtt, NULL);
+                group->cwin = cwin;
+            }
+            is_blocked = !picoquic_is_authorized_by_pacing(&group->pacing, current_time, next_time,
+                path_x->cnx->quic->packet_train_mode, path_x->cnx->quic);
+        }
+
+        if (is_blocked) {
+            path_x->cnx->quic->cc_manager->stats.nb_blocked++;
+        }
+    }
+
+    return is_blocked;
+}
+
+void picoquic_cc_manager_after_send(picoquic_path_t* path_x, size_t length, uint64_t current_time)
+{
+    if (path_x->cc_group->nb_members > 1 && path_x->cc_group->pacing.rate > 0) {
+        picoquic_update_pacing_data_after_send(&path_x->cc_group->pacing, length, path_x->send_mtu, current_time);
+    }
+}
@@ -0,0 +1,206 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Congestion control telemetry.
+*
+* Each path may carry a ring of congestion control samples, so that a
+* monitoring thread can display the state of many connections without
+* writing logs to disk. The network thread is the only writer. It records
+* at most one sample per interval, when the sender has prepared a packet
+* on the path. Readers run on any thread and never block the writer.
+*
+* Each slot is protected by a sequence number, as in a "seqlock". Sample
+* number s is stored in slot s % nb_samples. The writer first sets the slot
+* sequence to the odd value 2*s+1, writes the sample, and then sets the
+* slot sequence to 2*(s+1). A reader copies the slot and checks that the
+* sequence was 2*(s+1) both before and after the copy. If not, the sample
+* was overwritten by a more recent one, and the reader skips it.
+*
+* The ring is reference counted: the path holds one reference, and each
+* handle obtained with picoquic_get_cc_telemetry holds another. When the
+* path is deleted, the ring is marked closed and the path reference is
+* released, but the samples remain readable until the last handle is
+* released.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+typedef struct st_picoquic_cc_telemetry_slot_t {
+    volatile uint64_t seq;
+    picoquic_cc_sample_t sample;
+} picoquic_cc_telemetry_slot_t;
+
+struct st_picoquic_cc_telemetry_t {
+    volatile uint32_t ref_count;
+    volatile uint32_t is_closed;
+    volatile uint64_t next_sequence;
+    size_t nb_samples;
+    uint64_t sample_interval;
+    uint64_t last_sample_time;
+    picoquic_cc_telemetry_slot_t* slots;
+};
+
+void picoquic_set_default_cc_telemetry(picoquic_quic_t* quic, size_t nb_samples, uint64_t sample_interval)
+{
+    quic->cc_telemetry_nb_samples = nb_samples;
+    quic->cc_telemetry_interval = (sample_interval == 0) ? PICOQUIC_CC_TELEMETRY_INTERVAL : sample_interval;
+}
+
+static picoquic_cc_telemetry_t* picoquic_cc_telemetry_create(size_t nb_samples, uint64_t sample_interval)
+{
+    picoquic_cc_telemetry_t* telemetry = NULL;
+    size_t alloc_size = sizeof(picoquic_cc_telemetry_t) + nb_samples * sizeof(picoquic_cc_telemetry_slot_t);
+
+    if (nb_samples > 0 && nb_samples < SIZE_MAX / sizeof(picoquic_cc_telemetry_slot_t)) {
+        telemetry = (picoquic_cc_telemetry_t*)malloc(alloc_size);
+        if (telemetry != NULL) {
+            memset(telemetry, 0, alloc_size);
+            telemetry->ref_count = 1;
+            telemetry->nb_samples = nb_samples;
+            telemetry->sample_interval = sample_interval;
+            telemetry->slots = (picoquic_cc_telemetry_slot_t*)(telemetry + 1);
+        }
+    }
+
+    return telemetry;
+}
+
+void picoquic_cc_telemetry_attach(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    if (cnx->quic->cc_telemetry_nb_samples > 0 && path_x->cc_telemetry == NULL) {
+        path_x->cc_telemetry = picoquic_cc_telemetry_create(cnx->quic->cc_telemetry_nb_samples,
+            cnx->quic->cc_telemetry_interval);
+        if (path_x->cc_telemetry == NULL) {
+            DBG_PRINTF("Cannot allocate telemetry ring of %zu samples", cnx->quic->cc_telemetry_nb_samples);
+        }
+    }
+}
+
+void picoquic_cc_telemetry_detach(picoquic_path_t* path_x)
+{
+    if (path_x->cc_telemetry != NULL) {
+        PICOQUIC_TELEMETRY_STORE32(&path_x->cc_telemetry->is_closed, 1);
+        picoquic_release_cc_telemetry(path_x->cc_telemetry);
+        path_x->cc_telemetry = NULL;
+    }
+}
+
+picoquic_cc_telemetry_t* picoquic_get_cc_telemetry(picoquic_cnx_t* cnx, uint64_t unique_path_id)
+{
+    picoquic_cc_telemetry_t* telemetry = NULL;
+    int path_id = picoquic_get_path_id_from_unique(cnx, unique_path_id);
+
+    if (path_id >= 0 && cnx->path[path_id]->cc_telemetry != NULL) {
+        telemetry = cnx->path[path_id]->cc_telemetry;
+        (void)PICOQUIC_TELEMETRY_INCREF(&telemetry->ref_count);
+    }
+
+    return telemetry;
+}
+
+void picoquic_release_cc_telemetry(picoquic_cc_telemetry_t* telemetry)
+{
+    if (telemetry != NULL && PICOQUIC_TELEMETRY_DECREF(&telemetry->ref_count) == 0) {
+        free(telemetry);
+    }
+}
+
+int picoquic_cc_telemetry_is_closed(picoquic_cc_telemetry_t* telemetry)
+{
+    return (int)PICOQUIC_TELEMETRY_LOAD32(&telemetry->is_closed);
+}
+
+/* Called by the network thread after preparing a packet on the path. */
+void picoquic_cc_telemetry_record(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time)
+{
+    picoquic_cc_telemetry_t* telemetry = (path_x == NULL) ? NULL : path_x->cc_telemetry;
+
+    if (telemetry != NULL &&
+        (telemetry->next_sequence == 0 || current_time >= telemetry->last_sample_time + telemetry->sample_interval)) {
+        uint64_t s = telemetry->next_sequence;
+        picoquic_cc_telemetry_slot_t* slot = &telemetry->slots[s % telemetry->nb_samples];
+        picoquic_cc_sample_t* sample = &slot->sample;
+
+        PICOQUIC_TELEMETRY_STORE64(&slot->seq, 2 * s + 1);
+        PICOQUIC_TELEMETRY_WRITE_FENCE();
+
+        sample->sequence = s;
+        sample->sample_time = current_time;
+        sample->cwin = path_x->cwin;
+        sample->pacing_rate = path_x->pacing.rate;
+        sample->bandwidth_estimate = path_x->bandwidth_estimate;
+        sample->rtt_min = path_x->rtt_min;
+        sample->smoothed_rtt = path_x->smoothed_rtt;
+        sample->bytes_in_transit = path_x->bytes_in_transit;
+        sample->cc_state = 0;
+        sample->cc_param = 0;
+        sample->slow_start_exit_reason = (uint64_t)path_x->slow_start_exit_reason;
+        sample->slow_start_exit_time = path_x->slow_start_exit_time;
+        if (cnx->congestion_alg != NULL && cnx->congestion_alg->alg_observe != NULL &&
+            path_x->congestion_alg_state != NULL) {
+            cnx->congestion_alg->alg_observe(path_x, &sample->cc_state, &sample->cc_param);
+        }
+
+        PICOQUIC_TELEMETRY_STORE64(&slot->seq, 2 * (s + 1));
+        PICOQUIC_TELEMETRY_STORE64(&telemetry->next_sequence, s + 1);
+        telemetry->last_sample_time = current_time;
+    }
+}
+
+/* Called by the monitoring thread. Copies the samples starting at
+ * *next_sequence, and updates *next_sequence to the first sample not read. */
+size_t picoquic_read_cc_telemetry(picoquic_cc_telemetry_t* telemetry, uint64_t* next_sequence,
+    picoquic_cc_sample_t* samples, size_t max_samples)
+{
+    size_t nb_read = 0;
+    uint64_t head = PICOQUIC_TELEMETRY_LOAD64(&telemetry->next_sequence);
+    uint64_t s = *next_sequence;
+
+    if (head > telemetry->nb_samples && s < head - telemetry->nb_samples) {
+        s = head - telemetry->nb_samples;
+    }
+    else if (s > head) {
+        s = head;
+    }
+
+    while (s < head && nb_read < max_samples) {
+        picoquic_cc_telemetry_slot_t* slot = &telemetry->slots[s % telemetry->nb_samples];
+        uint64_t expected = 2 * (s + 1);
+
+        if (PICOQUIC_TELEMETRY_LOAD64(&slot->seq) == expected) {
+            memcpy(&samples[nb_read], (const void*)&slot->sample, sizeof(picoquic_cc_sample_t));
+            PICOQUIC_TELEMETRY_READ_FENCE();
+            if (PICOQUIC_TELEMETRY_LOAD64(&slot->seq) == expected) {
+                nb_read++;
+            }
+        }
+        s++;
+    }
+    *next_sequence = s;
+
+    return nb_read;
+}
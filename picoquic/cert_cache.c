@@ -0,0 +1,318 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Certificate verification cache.
+*
+* Clients that open many connections to the same servers validate the same
+* certificate chains again and again. When the cache is enabled, the
+* certificate verifier of the TLS context is wrapped by a caching verifier.
+* After a successful validation by the crypto provider, the leaf certificate
+* and the SNI are saved; if the same leaf is presented for the same SNI
+* before the lifetime expires, the chain validation is skipped.
+*
+* The handshake signature is always verified: on a cache hit, the crypto
+* provider builds the signature verifier from the public key of the leaf,
+* see picoquic_register_leaf_sign_verifier_fn. If the provider does not
+* support that, every connection goes through the full verification.
+*
+* Records are found by hashing the leaf and the SNI, and matched by
+* comparing the full leaf and SNI, so a hash collision cannot cause an
+* unverified certificate to be accepted. Records expire after the lifetime
+* even if they are used, so that revocation or expiry of the chain is
+* detected at the next full verification. The least recently validated
+* records are evicted when the cache is full. The cache is flushed when the
+* verifier is replaced.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picotls.h"
+#include "picoquic_internal.h"
+#include "picoquic_crypto_provider_api.h"
+#include "tls_api.h"
+
+#define PICOQUIC_CERT_CACHE_LIFETIME (300ull * 1000000ull)
+
+typedef struct st_picoquic_cert_record_t {
+    struct st_picoquic_cert_record_t* next_record;
+    struct st_picoquic_cert_record_t* previous_record;
+    picohash_item hash_item;
+    uint64_t saved_time;
+    const uint8_t* leaf;
+    size_t leaf_length;
+    const char* sni;
+    size_t sni_length;
+} picoquic_cert_record_t;
+
+struct st_picoquic_cert_cache_t {
+    ptls_verify_certificate_t super; /* installed in the TLS context */
+    ptls_verify_certificate_t* inner; /* verifier of the crypto provider */
+    picoquic_quic_t* quic;
+    picohash_table* table;
+    picoquic_cert_record_t* first;
+    picoquic_cert_record_t* last;
+    size_t nb_records;
+    size_t max_records;
+    uint64_t lifetime;
+    uint64_t nb_hits;
+    uint64_t nb_misses;
+};
+
+static uint64_t picoquic_cert_record_hash(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_cert_record_t* record = (const picoquic_cert_record_t*)key;
+
+    return picohash_siphash(record->leaf, record->leaf_length, hash_seed) ^
+        (picohash_siphash((const uint8_t*)record->sni, record->sni_length, hash_seed) * 0x9E3779B97F4A7C15ull);
+}
+
+static int picoquic_cert_record_compare(const void* key1, const void* key2)
+{
+    const picoquic_cert_record_t* record1 = (const picoquic_cert_record_t*)key1;
+    const picoquic_cert_record_t* record2 = (const picoquic_cert_record_t*)key2;
+
+    return (record1->leaf_length == record2->leaf_length &&
+        record1->sni_length == record2->sni_length &&
+        memcmp(record1->leaf, record2->leaf, record1->leaf_length) == 0 &&
+        memcmp(record1->sni, record2->sni, record1->sni_length) == 0) ? 0 : 1;
+}
+
+static picohash_item* picoquic_cert_record_to_item(const void* key)
+{
+    picoquic_cert_record_t* record = (picoquic_cert_record_t*)key;
+
+    return &record->hash_item;
+}
+
+static void picoquic_cert_record_delete(picoquic_cert_cache_t* cert_cache, picoquic_cert_record_t* record)
+{
+    if (record->next_record == NULL) {
+        cert_cache->last = record->previous_record;
+    }
+    else {
+        record->next_record->previous_record = record->previous_record;
+    }
+
+    if (record->previous_record == NULL) {
+        cert_cache->first = record->next_record;
+    }
+    else {
+        record->previous_record->next_record = record->next_record;
+    }
+
+    picohash_delete_key(cert_cache->table, record, 1);
+
+    if (cert_cache->nb_records > 0) {
+        cert_cache->nb_records--;
+    }
+}
+
+static picoquic_cert_record_t* picoquic_cert_cache_find(picoquic_cert_cache_t* cert_cache,
+    ptls_iovec_t leaf, const char* server_name, uint64_t current_time)
+{
+    picoquic_cert_record_t* record = NULL;
+    picoquic_cert_record_t key;
+    picohash_item* item;
+
+    memset(&key, 0, sizeof(key));
+    key.leaf = leaf.base;
+    key.leaf_length = leaf.len;
+    key.sni = (server_name == NULL) ? "" : server_name;
+    key.sni_length = strlen(key.sni);
+
+    item = picohash_retrieve(cert_cache->table, &key);
+    if (item != NULL) {
+        record = (picoquic_cert_record_t*)item->key;
+        if (record->saved_time + cert_cache->lifetime <= current_time) {
+            picoquic_cert_record_delete(cert_cache, record);
+            record = NULL;
+        }
+    }
+
+    return record;
+}
+
+/* The record and the copies of the leaf and SNI are allocated together */
+static void picoquic_cert_cache_save(picoquic_cert_cache_t* cert_cache,
+    ptls_iovec_t leaf, const char* server_name, uint64_t current_time)
+{
+    const char* sni = (server_name == NULL) ? "" : server_name;
+    size_t sni_length = strlen(sni);
+    picoquic_cert_record_t* record = picoquic_cert_cache_find(cert_cache, leaf, server_name, current_time);
+
+    if (record != NULL) {
+        picoquic_cert_record_delete(cert_cache, record);
+    }
+    while (cert_cache->nb_records >= cert_cache->max_records && cert_cache->last != NULL) {
+        picoquic_cert_record_delete(cert_cache, cert_cache->last);
+    }
+    record = (picoquic_cert_record_t*)malloc(sizeof(picoquic_cert_record_t) + leaf.len + sni_length);
+    if (record != NULL) {
+        uint8_t* bytes = ((uint8_t*)record) + sizeof(picoquic_cert_record_t);
+
+        memset(record, 0, sizeof(picoquic_cert_record_t));
+        memcpy(bytes, leaf.base, leaf.len);
+        memcpy(bytes + leaf.len, sni, sni_length);
+        record->leaf = bytes;
+        record->leaf_length = leaf.len;
+        record->sni = (const char*)(bytes + leaf.len);
+        record->sni_length = sni_length;
+        record->saved_time = current_time;
+        record->next_record = cert_cache->first;
+        if (record->next_record == NULL) {
+            cert_cache->last = record;
+        }
+        else {
+            record->next_record->previous_record = record;
+        }
+        cert_cache->first = record;
+        if (picohash_insert(cert_cache->table, record) == 0) {
+            cert_cache->nb_records++;
+        }
+        else {
+            cert_cache->first = record->next_record;
+            if (cert_cache->first == NULL) {
+                cert_cache->last = NULL;
+            }
+            else {
+                cert_cache->first->previous_record = NULL;
+            }
+            free(record);
+        }
+    }
+}
+
+/* Verifier installed in the TLS context while the cache is enabled. */
+static int picoquic_cert_cache_verify_cb(ptls_verify_certificate_t* self, ptls_t* tls, const char* server_name,
+    int (**verify_sign)(void* verify_ctx, uint16_t algo, ptls_iovec_t data, ptls_iovec_t sign),
+    void** verify_data, ptls_iovec_t* certs, size_t num_certs)
+{
+    int ret;
+    picoquic_cert_cache_t* cert_cache = (picoquic_cert_cache_t*)self;
+    uint64_t current_time = picoquic_get_quic_time(cert_cache->quic);
+    picoquic_cert_record_t* record = NULL;
+
+    if (num_certs > 0 && picoquic_get_leaf_sign_verifier_fn != NULL) {
+        record = picoquic_cert_cache_find(cert_cache, certs[0], server_name, current_time);
+    }
+
+    if (record != NULL && picoquic_get_leaf_sign_verifier_fn(certs[0], verify_sign, verify_data) == 0) {
+        cert_cache->nb_hits++;
+        ret = 0;
+    }
+    else {
+        cert_cache->nb_misses++;
+        ret = cert_cache->inner->cb(cert_cache->inner, tls, server_name, verify_sign, verify_data, certs, num_certs);
+        if (ret == 0 && num_certs > 0) {
+            picoquic_cert_cache_save(cert_cache, certs[0], server_name, current_time);
+        }
+    }
+
+    return ret;
+}
+
+/* Install the caching verifier in front of the verifier of the context,
+ * if both exist. */
+void picoquic_cert_cache_wrap(picoquic_quic_t* quic)
+{
+    picoquic_cert_cache_t* cert_cache = quic->cert_cache;
+    ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+
+    if (cert_cache != NULL && ctx != NULL && ctx->verify_certificate != NULL &&
+        ctx->verify_certificate != &cert_cache->super) {
+        cert_cache->inner = ctx->verify_certificate;
+        cert_cache->super.algos = cert_cache->inner->algos;
+        ctx->verify_certificate = &cert_cache->super;
+    }
+}
+
+/* Restore the verifier of the crypto provider in the context. */
+void picoquic_cert_cache_unwrap(picoquic_quic_t* quic)
+{
+    picoquic_cert_cache_t* cert_cache = quic->cert_cache;
+    ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+
+    if (cert_cache != NULL && ctx != NULL && ctx->verify_certificate == &cert_cache->super) {
+        ctx->verify_certificate = cert_cache->inner;
+        cert_cache->inner = NULL;
+    }
+}
+
+void picoquic_cert_cache_flush(picoquic_quic_t* quic)
+{
+    if (quic->cert_cache != NULL) {
+        while (quic->cert_cache->first != NULL) {
+            picoquic_cert_record_delete(quic->cert_cache, quic->cert_cache->first);
+        }
+    }
+}
+
+void picoquic_cert_cache_free(picoquic_quic_t* quic)
+{
+    if (quic->cert_cache != NULL) {
+        picoquic_cert_cache_unwrap(quic);
+        picoquic_cert_cache_flush(quic);
+        picohash_delete(quic->cert_cache->table, 1);
+        free(quic->cert_cache);
+        quic->cert_cache = NULL;
+    }
+}
+
+int picoquic_set_cert_verify_cache(picoquic_quic_t* quic, size_t max_records, uint64_t lifetime)
+{
+    int ret = 0;
+
+    picoquic_cert_cache_free(quic);
+
+    if (max_records > 0) {
+        picoquic_cert_cache_t* cert_cache = (picoquic_cert_cache_t*)malloc(sizeof(picoquic_cert_cache_t));
+
+        if (cert_cache == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(cert_cache, 0, sizeof(picoquic_cert_cache_t));
+            cert_cache->super.cb = picoquic_cert_cache_verify_cb;
+            cert_cache->quic = quic;
+            cert_cache->max_records = max_records;
+            cert_cache->lifetime = (lifetime == 0) ? PICOQUIC_CERT_CACHE_LIFETIME : lifetime;
+            cert_cache->table = picohash_create_ex(max_records, picoquic_cert_record_hash,
+                picoquic_cert_record_compare, picoquic_cert_record_to_item, quic->hash_seed);
+            if (cert_cache->table == NULL) {
+                free(cert_cache);
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                quic->cert_cache = cert_cache;
+                picoquic_cert_cache_wrap(quic);
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_get_cert_verify_cache_stats(picoquic_quic_t* quic, uint64_t* nb_hits, uint64_t* nb_misses)
+{
+    *nb_hits = (quic->cert_cache == NULL) ? 0 : quic->cert_cache->nb_hits;
+    *nb_misses = (quic->cert_cache == NULL) ? 0 : quic->cert_cache->nb_misses;
+}
@@ -0,0 +1,367 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* TLS certificate compression, as specified in RFC 8879.
+*
+* On the server side, the "emit_certificate" callback of the TLS context sends
+* a CompressedCertificate message if the client supports one of the compiled
+* algorithms. The compressed message is computed once per certificate chain and
+* algorithm, the first time it is needed, and then reused for all handshakes.
+* The cache is reset when the chain is replaced.
+*
+* On the client side, the "decompress_certificate" callback announces the
+* compiled algorithms and decompresses the server certificates.
+*
+* Algorithms are compiled in if the corresponding library was found by the
+* build: PICOQUIC_WITH_ZLIB, PICOQUIC_WITH_BROTLI, PICOQUIC_WITH_ZSTD.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "picotls.h"
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "tls_api.h"
+#ifdef PICOQUIC_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PICOQUIC_WITH_BROTLI
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+#endif
+#ifdef PICOQUIC_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#define PICOQUIC_CERT_COMPRESSION_ZLIB 1
+#define PICOQUIC_CERT_COMPRESSION_BROTLI 2
+#define PICOQUIC_CERT_COMPRESSION_ZSTD 3
+#define PICOQUIC_CERT_COMPRESSION_MAX_ALGOS 3
+
+/* Supported algorithms, by order of preference, terminated by UINT16_MAX */
+static const uint16_t picoquic_cert_compression_algos[] = {
+#ifdef PICOQUIC_WITH_BROTLI
+    PICOQUIC_CERT_COMPRESSION_BROTLI,
+#endif
+#ifdef PICOQUIC_WITH_ZSTD
+    PICOQUIC_CERT_COMPRESSION_ZSTD,
+#endif
+#ifdef PICOQUIC_WITH_ZLIB
+    PICOQUIC_CERT_COMPRESSION_ZLIB,
+#endif
+    UINT16_MAX
+};
+
+typedef struct st_picoquic_compressed_cert_t {
+    uint16_t algorithm;
+    int is_computed; /* set even if compression failed, to not retry at each handshake */
+    uint8_t* bytes;
+    size_t length;
+    size_t uncompressed_length;
+} picoquic_compressed_cert_t;
+
+typedef struct st_picoquic_cert_compress_ctx_t {
+    ptls_emit_certificate_t emit;
+    ptls_decompress_certificate_t decompress;
+    ptls_context_t* tls_ctx;
+    ptls_iovec_t* cached_list;
+    size_t cached_count;
+    picoquic_compressed_cert_t cert[PICOQUIC_CERT_COMPRESSION_MAX_ALGOS];
+} picoquic_cert_compress_ctx_t;
+
+/* Compress the input into a newly allocated buffer. Returns 0 if the
+ * compressed data is shorter than the input. */
+static int picoquic_cert_compress(uint16_t algorithm, const uint8_t* input, size_t input_length,
+    uint8_t** compressed, size_t* compressed_length)
+{
+    int ret = -1;
+    size_t bound = input_length + 64;
+    uint8_t* bytes = NULL;
+
+    *compressed = NULL;
+    *compressed_length = 0;
+
+    switch (algorithm) {
+#ifdef PICOQUIC_WITH_ZLIB
+    case PICOQUIC_CERT_COMPRESSION_ZLIB:
+        bound = compressBound((uLong)input_length);
+        if ((bytes = (uint8_t*)malloc(bound)) != NULL) {
+            uLongf dest_len = (uLongf)bound;
+            if (compress2(bytes, &dest_len, input, (uLong)input_length, Z_BEST_COMPRESSION) == Z_OK) {
+                *compressed_length = dest_len;
+                ret = 0;
+            }
+        }
+        break;
+#endif
+#ifdef PICOQUIC_WITH_BROTLI
+    case PICOQUIC_CERT_COMPRESSION_BROTLI:
+        bound = BrotliEncoderMaxCompressedSize(input_length);
+        if (bound > 0 && (bytes = (uint8_t*)malloc(bound)) != NULL) {
+            size_t dest_len = bound;
+            if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                input_length, input, &dest_len, bytes) == BROTLI_TRUE) {
+                *compressed_length = dest_len;
+                ret = 0;
+            }
+        }
+        break;
+#endif
+#ifdef PICOQUIC_WITH_ZSTD
+    case PICOQUIC_CERT_COMPRESSION_ZSTD:
+        bound = ZSTD_compressBound(input_length);
+        if ((bytes = (uint8_t*)malloc(bound)) != NULL) {
+            size_t dest_len = ZSTD_compress(bytes, bound, input, input_length, ZSTD_maxCLevel());
+            if (!ZSTD_isError(dest_len)) {
+                *compressed_length = dest_len;
+                ret = 0;
+            }
+        }
+        break;
+#endif
+    default:
+        (void)input;
+        break;
+    }
+
+    if (ret == 0 && *compressed_length >= input_length) {
+        /* Compression would not save anything */
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        *compressed = bytes;
+    }
+    else if (bytes != NULL) {
+        free(bytes);
+    }
+    (void)bound;
+
+    return ret;
+}
+
+/* Decompress exactly output_length bytes */
+static int picoquic_cert_decompress(uint16_t algorithm, uint8_t* output, size_t output_length,
+    const uint8_t* input, size_t input_length)
+{
+    int ret = -1;
+
+    switch (algorithm) {
+#ifdef PICOQUIC_WITH_ZLIB
+    case PICOQUIC_CERT_COMPRESSION_ZLIB: {
+        uLongf dest_len = (uLongf)output_length;
+        if (uncompress(output, &dest_len, input, (uLong)input_length) == Z_OK && dest_len == output_length) {
+            ret = 0;
+        }
+        break;
+    }
+#endif
+#ifdef PICOQUIC_WITH_BROTLI
+    case PICOQUIC_CERT_COMPRESSION_BROTLI: {
+        size_t dest_len = output_length;
+        if (BrotliDecoderDecompress(input_length, input, &dest_len, output) == BROTLI_DECODER_RESULT_SUCCESS &&
+            dest_len == output_length) {
+            ret = 0;
+        }
+        break;
+    }
+#endif
+#ifdef PICOQUIC_WITH_ZSTD
+    case PICOQUIC_CERT_COMPRESSION_ZSTD: {
+        size_t dest_len = ZSTD_decompress(output, output_length, input, input_length);
+        if (!ZSTD_isError(dest_len) && dest_len == output_length) {
+            ret = 0;
+        }
+        break;
+    }
+#endif
+    default:
+        (void)output;
+        (void)output_length;
+        (void)input;
+        (void)input_length;
+        break;
+    }
+
+    return ret;
+}
+
+static void picoquic_cert_compress_reset(picoquic_cert_compress_ctx_t* cc_ctx)
+{
+    for (int i = 0; i < PICOQUIC_CERT_COMPRESSION_MAX_ALGOS; i++) {
+        if (cc_ctx->cert[i].bytes != NULL) {
+            free(cc_ctx->cert[i].bytes);
+        }
+        memset(&cc_ctx->cert[i], 0, sizeof(picoquic_compressed_cert_t));
+    }
+    cc_ctx->cached_list = NULL;
+    cc_ctx->cached_count = 0;
+}
+
+/* Return the compressed certificate message for the algorithm, computing
+ * it if this is the first use with the current chain. */
+static picoquic_compressed_cert_t* picoquic_cert_compress_get(picoquic_cert_compress_ctx_t* cc_ctx, uint16_t algorithm)
+{
+    picoquic_compressed_cert_t* cert = NULL;
+    ptls_context_t* ctx = cc_ctx->tls_ctx;
+
+    if (cc_ctx->cached_list != ctx->certificates.list || cc_ctx->cached_count != ctx->certificates.count) {
+        picoquic_cert_compress_reset(cc_ctx);
+        cc_ctx->cached_list = ctx->certificates.list;
+        cc_ctx->cached_count = ctx->certificates.count;
+    }
+
+    for (int i = 0; i < PICOQUIC_CERT_COMPRESSION_MAX_ALGOS; i++) {
+        if (cc_ctx->cert[i].algorithm == algorithm || cc_ctx->cert[i].algorithm == 0) {
+            cert = &cc_ctx->cert[i];
+            break;
+        }
+    }
+
+    if (cert != NULL && !cert->is_computed) {
+        ptls_buffer_t uncompressed;
+
+        cert->algorithm = algorithm;
+        cert->is_computed = 1;
+        ptls_buffer_init(&uncompressed, "", 0);
+        if (ptls_build_certificate_message(&uncompressed, ptls_iovec_init(NULL, 0), ctx->certificates.list,
+            ctx->certificates.count, ptls_iovec_init(NULL, 0)) == 0 &&
+            picoquic_cert_compress(algorithm, uncompressed.base, uncompressed.off, &cert->bytes, &cert->length) == 0) {
+            cert->uncompressed_length = uncompressed.off;
+        }
+        ptls_buffer_dispose(&uncompressed);
+    }
+
+    if (cert != NULL && cert->bytes == NULL) {
+        cert = NULL;
+    }
+
+    return cert;
+}
+
+static int picoquic_emit_compressed_certificate(ptls_emit_certificate_t* self, ptls_t* tls, ptls_message_emitter_t* emitter,
+    ptls_key_schedule_t* key_sched, ptls_iovec_t context, int push_status_request, const uint16_t* compress_algos,
+    size_t num_compress_algos)
+{
+    picoquic_cert_compress_ctx_t* cc_ctx = (picoquic_cert_compress_ctx_t*)
+        (((uint8_t*)self) - offsetof(picoquic_cert_compress_ctx_t, emit));
+    picoquic_compressed_cert_t* cert = NULL;
+    int ret = PTLS_ERROR_DELEGATE;
+
+    (void)tls;
+
+    /* Precomputation is only possible for the server chain, without OCSP status */
+    if (context.len == 0 && !push_status_request) {
+        for (size_t i = 0; cert == NULL && i < num_compress_algos; i++) {
+            for (const uint16_t* algo = picoquic_cert_compression_algos; *algo != UINT16_MAX; algo++) {
+                if (*algo == compress_algos[i]) {
+                    cert = picoquic_cert_compress_get(cc_ctx, *algo);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (cert != NULL) {
+        /* The picotls message macros require "ret" and the "Exit" label */
+        ret = 0;
+        ptls_push_message(emitter, key_sched, PTLS_HANDSHAKE_TYPE_COMPRESSED_CERTIFICATE, {
+            ptls_buffer_push16(emitter->buf, cert->algorithm);
+            ptls_buffer_push24(emitter->buf, (uint32_t)cert->uncompressed_length);
+            ptls_buffer_push_block(emitter->buf, 3, { ptls_buffer_pushv(emitter->buf, cert->bytes, cert->length); });
+        });
+    }
+Exit:
+    return ret;
+}
+
+static int picoquic_decompress_certificate(ptls_decompress_certificate_t* self, ptls_t* tls, uint16_t algorithm,
+    ptls_iovec_t output, ptls_iovec_t input)
+{
+    int ret = 0;
+
+    (void)self;
+    (void)tls;
+
+    if (picoquic_cert_decompress(algorithm, output.base, output.len, input.base, input.len) != 0) {
+        ret = PTLS_ALERT_BAD_CERTIFICATE;
+    }
+
+    return ret;
+}
+
+int picoquic_set_certificate_compression(picoquic_quic_t* quic, int enable)
+{
+    int ret = 0;
+    ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+    picoquic_cert_compress_ctx_t* cc_ctx = (picoquic_cert_compress_ctx_t*)quic->cert_compress_ctx;
+
+    if (!enable) {
+        if (cc_ctx != NULL) {
+            if (ctx != NULL) {
+                if (ctx->emit_certificate == &cc_ctx->emit) {
+                    ctx->emit_certificate = NULL;
+                }
+                if (ctx->decompress_certificate == &cc_ctx->decompress) {
+                    ctx->decompress_certificate = NULL;
+                }
+            }
+            picoquic_cert_compress_reset(cc_ctx);
+            free(cc_ctx);
+            quic->cert_compress_ctx = NULL;
+        }
+    }
+    else if (ctx == NULL || picoquic_cert_compression_algos[0] == UINT16_MAX) {
+        /* No compression library in this build */
+        ret = -1;
+    }
+    else if (cc_ctx == NULL) {
+        if ((cc_ctx = (picoquic_cert_compress_ctx_t*)malloc(sizeof(picoquic_cert_compress_ctx_t))) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(cc_ctx, 0, sizeof(picoquic_cert_compress_ctx_t));
+            cc_ctx->emit.cb = picoquic_emit_compressed_certificate;
+            cc_ctx->decompress.supported_algorithms = picoquic_cert_compression_algos;
+            cc_ctx->decompress.cb = picoquic_decompress_certificate;
+            cc_ctx->tls_ctx = ctx;
+            ctx->emit_certificate = &cc_ctx->emit;
+            ctx->decompress_certificate = &cc_ctx->decompress;
+            quic->cert_compress_ctx = cc_ctx;
+        }
+    }
+
+    return ret;
+}
+
+/* Called when the certificate chain is replaced, so the compressed
+ * messages are recomputed even if the new list reuses the same memory. */
+void picoquic_certificate_compression_reset(picoquic_quic_t* quic)
+{
+    if (quic->cert_compress_ctx != NULL) {
+        picoquic_cert_compress_reset((picoquic_cert_compress_ctx_t*)quic->cert_compress_ctx);
+    }
+}
@@ -0,0 +1,1069 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Connection handoff between server processes.
+*
+* A server that restarts or sheds load behind a load balancer routing on
+* connection IDs can hand its established connections to another process,
+* instead of letting them time out. The old server exports the state of
+* the connection, the new server imports it, and the packets that the load
+* balancer forwards to the new server are then processed as if nothing
+* had happened.
+*
+* The TLS session is not transferred: once the handshake is complete, the
+* only TLS state needed by QUIC is the pair of application traffic secrets,
+* from which the packet protection keys and the later key updates are
+* derived. The export is only possible if the keys were never updated,
+* because the header protection keys are derived from the initial secrets
+* and those are not retained.
+*
+* The packets in flight are not transferred either. The new server starts
+* with empty retransmission queues, and everything that the peer did not
+* acknowledge is queued again: the stream data above the acknowledged
+* prefix of each stream, the NEW_CONNECTION_ID frames that were not acked,
+* and the flow control updates. This may repeat some data that the peer
+* already received, which is harmless. The packet numbers continue from
+* the last packet sent by the old server.
+*
+* The snapshot is a sequence of varints, in the style of the congestion
+* control snapshots, starting with a version number.
+*/
+
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "tls_api.h"
+#include "cc_common.h"
+
+#define PICOQUIC_HANDOFF_VERSION 1
+#define PICOQUIC_HANDOFF_NB_SCALARS 7
+#define PICOQUIC_HANDOFF_NB_TP_VALUES 19
+#define PICOQUIC_HANDOFF_CNX_FIELDS_MAX 64
+#define PICOQUIC_HANDOFF_NB_STREAM_FIELDS 7
+#define PICOQUIC_HANDOFF_NB_STREAM_VALUES 5
+#define PICOQUIC_HANDOFF_NAME_MAX 256
+#define PICOQUIC_HANDOFF_FRAME_MAX 64
+
+/* Flags of the connection, mostly the result of the transport parameter negotiation */
+#define PICOQUIC_HANDOFF_FLAG(flags, n) ((unsigned int)(((flags) >> (n)) & 1))
+
+static uint64_t picoquic_handoff_get_flags(picoquic_cnx_t* cnx)
+{
+    const unsigned int bits[] = {
+        cnx->is_new_token_acked,
+        cnx->is_1rtt_received,
+        cnx->is_1rtt_acked,
+        cnx->is_loss_bit_enabled_incoming,
+        cnx->is_loss_bit_enabled_outgoing,
+        cnx->is_ack_frequency_negotiated,
+        cnx->is_time_stamp_enabled,
+        cnx->is_time_stamp_sent,
+        cnx->is_hcid_verified,
+        cnx->do_grease_quic_bit,
+        cnx->ack_ignore_order_local,
+        cnx->ack_ignore_order_remote,
+        cnx->do_version_negotiation,
+        cnx->send_receive_bdp_frame,
+        cnx->is_address_discovery_provider,
+        cnx->is_address_discovery_receiver
+    };
+    uint64_t flags = 0;
+
+    for (size_t i = 0; i < sizeof(bits) / sizeof(unsigned int); i++) {
+        flags |= ((uint64_t)(bits[i] != 0)) << i;
+    }
+
+    return flags;
+}
+
+static void picoquic_handoff_set_flags(picoquic_cnx_t* cnx, uint64_t flags)
+{
+    cnx->is_new_token_acked = PICOQUIC_HANDOFF_FLAG(flags, 0);
+    cnx->is_1rtt_received = PICOQUIC_HANDOFF_FLAG(flags, 1);
+    cnx->is_1rtt_acked = PICOQUIC_HANDOFF_FLAG(flags, 2);
+    cnx->is_loss_bit_enabled_incoming = PICOQUIC_HANDOFF_FLAG(flags, 3);
+    cnx->is_loss_bit_enabled_outgoing = PICOQUIC_HANDOFF_FLAG(flags, 4);
+    cnx->is_ack_frequency_negotiated = PICOQUIC_HANDOFF_FLAG(flags, 5);
+    cnx->is_time_stamp_enabled = PICOQUIC_HANDOFF_FLAG(flags, 6);
+    cnx->is_time_stamp_sent = PICOQUIC_HANDOFF_FLAG(flags, 7);
+    cnx->is_hcid_verified = PICOQUIC_HANDOFF_FLAG(flags, 8);
+    cnx->do_grease_quic_bit = PICOQUIC_HANDOFF_FLAG(flags, 9);
+    cnx->ack_ignore_order_local = PICOQUIC_HANDOFF_FLAG(flags, 10);
+    cnx->ack_ignore_order_remote = PICOQUIC_HANDOFF_FLAG(flags, 11);
+    cnx->do_version_negotiation = PICOQUIC_HANDOFF_FLAG(flags, 12);
+    cnx->send_receive_bdp_frame = PICOQUIC_HANDOFF_FLAG(flags, 13);
+    cnx->is_address_discovery_provider = PICOQUIC_HANDOFF_FLAG(flags, 14);
+    cnx->is_address_discovery_receiver = PICOQUIC_HANDOFF_FLAG(flags, 15);
+}
+
+/* The 64 bit variables of the connection are listed once, and that list is
+ * used for both export and import, so the two cannot diverge. */
+static size_t picoquic_handoff_cnx_fields(picoquic_cnx_t* cnx, uint64_t** fields)
+{
+    picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+    picoquic_ack_context_t* ack_ctx = &cnx->ack_ctx[picoquic_packet_context_application];
+    size_t n = 0;
+
+    fields[n++] = &cnx->idle_timeout;
+    fields[n++] = &cnx->keep_alive_interval;
+    fields[n++] = &cnx->nb_packets_sent;
+    fields[n++] = &cnx->crypto_epoch_sequence;
+    fields[n++] = &cnx->ack_frequency_sequence_local;
+    fields[n++] = &cnx->ack_gap_local;
+    fields[n++] = &cnx->ack_frequency_delay_local;
+    fields[n++] = &cnx->ack_frequency_sequence_remote;
+    fields[n++] = &cnx->ack_gap_remote;
+    fields[n++] = &cnx->ack_delay_remote;
+    fields[n++] = &cnx->ack_reordering_threshold_local;
+    fields[n++] = &cnx->ack_reordering_threshold_remote;
+    fields[n++] = &cnx->max_ack_delay_remote;
+    fields[n++] = &cnx->max_ack_gap_remote;
+    fields[n++] = &cnx->max_ack_delay_local;
+    fields[n++] = &cnx->max_ack_gap_local;
+    fields[n++] = &cnx->min_ack_delay_remote;
+    fields[n++] = &cnx->min_ack_delay_local;
+    fields[n++] = &cnx->data_received;
+    fields[n++] = &cnx->maxdata_local;
+    fields[n++] = &cnx->maxdata_local_acked;
+    fields[n++] = &cnx->maxdata_remote;
+    fields[n++] = &cnx->max_stream_data_local;
+    fields[n++] = &cnx->max_stream_data_remote;
+    fields[n++] = &cnx->max_stream_id_bidir_local;
+    fields[n++] = &cnx->max_stream_id_bidir_rank_acked;
+    fields[n++] = &cnx->max_stream_id_bidir_local_computed;
+    fields[n++] = &cnx->max_stream_id_unidir_local;
+    fields[n++] = &cnx->max_stream_id_unidir_rank_acked;
+    fields[n++] = &cnx->max_stream_id_unidir_local_computed;
+    fields[n++] = &cnx->max_stream_id_bidir_remote;
+    fields[n++] = &cnx->max_stream_id_unidir_remote;
+    for (int i = 0; i < 4; i++) {
+        fields[n++] = &cnx->next_stream_id[i];
+    }
+    fields[n++] = &pkt_ctx->send_sequence;
+    fields[n++] = &pkt_ctx->highest_acknowledged;
+    fields[n++] = &pkt_ctx->ecn_ect0_total_remote;
+    fields[n++] = &pkt_ctx->ecn_ect1_total_remote;
+    fields[n++] = &pkt_ctx->ecn_ce_total_remote;
+    fields[n++] = &ack_ctx->crypto_rotation_sequence;
+    fields[n++] = &ack_ctx->ecn_ect0_total_local;
+    fields[n++] = &ack_ctx->ecn_ect1_total_local;
+    fields[n++] = &ack_ctx->ecn_ce_total_local;
+
+    return n;
+}
+
+static void picoquic_handoff_get_tp(const picoquic_tp_t* tp, uint64_t* values)
+{
+    values[0] = tp->initial_max_stream_data_bidi_local;
+    values[1] = tp->initial_max_stream_data_bidi_remote;
+    values[2] = tp->initial_max_stream_data_uni;
+    values[3] = tp->initial_max_data;
+    values[4] = tp->initial_max_stream_id_bidir;
+    values[5] = tp->initial_max_stream_id_unidir;
+    values[6] = tp->max_idle_timeout;
+    values[7] = tp->max_packet_size;
+    values[8] = tp->max_ack_delay;
+    values[9] = tp->active_connection_id_limit;
+    values[10] = tp->ack_delay_exponent;
+    values[11] = tp->migration_disabled;
+    values[12] = tp->max_datagram_frame_size;
+    values[13] = (uint64_t)tp->enable_loss_bit;
+    values[14] = (uint64_t)tp->enable_time_stamp;
+    values[15] = tp->min_ack_delay;
+    values[16] = (uint64_t)tp->do_grease_quic_bit;
+    values[17] = (uint64_t)tp->enable_bdp_frame;
+    values[18] = (uint64_t)tp->address_discovery_mode;
+}
+
+static void picoquic_handoff_set_tp(picoquic_tp_t* tp, const uint64_t* values)
+{
+    tp->initial_max_stream_data_bidi_local = values[0];
+    tp->initial_max_stream_data_bidi_remote = values[1];
+    tp->initial_max_stream_data_uni = values[2];
+    tp->initial_max_data = values[3];
+    tp->initial_max_stream_id_bidir = values[4];
+    tp->initial_max_stream_id_unidir = values[5];
+    tp->max_idle_timeout = values[6];
+    tp->max_packet_size = (uint32_t)values[7];
+    tp->max_ack_delay = (uint32_t)values[8];
+    tp->active_connection_id_limit = (uint32_t)values[9];
+    tp->ack_delay_exponent = (uint8_t)values[10];
+    tp->migration_disabled = (unsigned int)values[11];
+    tp->max_datagram_frame_size = (uint32_t)values[12];
+    tp->enable_loss_bit = (int)values[13];
+    tp->enable_time_stamp = (int)values[14];
+    tp->min_ack_delay = values[15];
+    tp->do_grease_quic_bit = (int)values[16];
+    tp->enable_bdp_frame = (int)values[17];
+    tp->address_discovery_mode = (int)values[18];
+    /* The peer already acted on the preferred address, if any */
+    tp->prefered_address.is_defined = 0;
+}
+
+static uint8_t* picoquic_handoff_addr_encode(uint8_t* bytes, const uint8_t* bytes_max, const struct sockaddr_storage* addr)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in* a4 = (const struct sockaddr_in*)addr;
+        if ((bytes = picoquic_frames_uint8_encode(bytes, bytes_max, 4)) != NULL &&
+            (bytes = picoquic_frames_length_data_encode(bytes, bytes_max, 4, (const uint8_t*)&a4->sin_addr)) != NULL) {
+            bytes = picoquic_frames_uint16_encode(bytes, bytes_max, a4->sin_port);
+        }
+    }
+    else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)addr;
+        if ((bytes = picoquic_frames_uint8_encode(bytes, bytes_max, 6)) != NULL &&
+            (bytes = picoquic_frames_length_data_encode(bytes, bytes_max, 16, (const uint8_t*)&a6->sin6_addr)) != NULL) {
+            bytes = picoquic_frames_uint16_encode(bytes, bytes_max, a6->sin6_port);
+        }
+    }
+    else {
+        bytes = picoquic_frames_uint8_encode(bytes, bytes_max, 0);
+    }
+    return bytes;
+}
+
+static const uint8_t* picoquic_handoff_data_decode(const uint8_t* bytes, const uint8_t* bytes_max, const uint8_t** data, size_t* length)
+{
+    if ((bytes = picoquic_frames_varlen_decode(bytes, bytes_max, length)) != NULL) {
+        if ((size_t)(bytes_max - bytes) < *length) {
+            bytes = NULL;
+        }
+        else {
+            *data = bytes;
+            bytes += *length;
+        }
+    }
+    return bytes;
+}
+
+static const uint8_t* picoquic_handoff_addr_decode(const uint8_t* bytes, const uint8_t* bytes_max, struct sockaddr_storage* addr)
+{
+    uint8_t family = 0;
+    const uint8_t* data = NULL;
+    size_t length = 0;
+    uint16_t port = 0;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if ((bytes = picoquic_frames_uint8_decode(bytes, bytes_max, &family)) != NULL && family != 0) {
+        if ((bytes = picoquic_handoff_data_decode(bytes, bytes_max, &data, &length)) == NULL ||
+            (bytes = picoquic_frames_uint16_decode(bytes, bytes_max, &port)) == NULL) {
+            bytes = NULL;
+        }
+        else if (family == 4 && length == 4) {
+            struct sockaddr_in* a4 = (struct sockaddr_in*)addr;
+            a4->sin_family = AF_INET;
+            memcpy(&a4->sin_addr, data, 4);
+            a4->sin_port = port;
+        }
+        else if (family == 6 && length == 16) {
+            struct sockaddr_in6* a6 = (struct sockaddr_in6*)addr;
+            a6->sin6_family = AF_INET6;
+            memcpy(&a6->sin6_addr, data, 16);
+            a6->sin6_port = port;
+        }
+        else {
+            bytes = NULL;
+        }
+    }
+    return bytes;
+}
+
+static const uint8_t* picoquic_handoff_name_decode(const uint8_t* bytes, const uint8_t* bytes_max, char* name)
+{
+    const uint8_t* data = NULL;
+    size_t length = 0;
+
+    if ((bytes = picoquic_handoff_data_decode(bytes, bytes_max, &data, &length)) != NULL) {
+        if (length >= PICOQUIC_HANDOFF_NAME_MAX) {
+            bytes = NULL;
+        }
+        else {
+            memcpy(name, data, length);
+            name[length] = 0;
+        }
+    }
+    return bytes;
+}
+
+/* The acknowledged prefix of the stream. Data above it will be sent again
+ * by the new server. */
+static uint64_t picoquic_handoff_stream_acked_offset(picoquic_stream_head_t* stream)
+{
+    uint64_t acked_offset = 0;
+    picoquic_sack_item_t* first = picoquic_sack_first_item(&stream->sack_list);
+
+    if (first != NULL && picoquic_sack_item_range_start(first) == 0) {
+        acked_offset = picoquic_sack_item_range_end(first) + 1;
+    }
+    if (acked_offset > stream->sent_offset) {
+        /* The ack of the FIN covers one more than the data */
+        acked_offset = stream->sent_offset;
+    }
+    return acked_offset;
+}
+
+static size_t picoquic_handoff_stream_queued_length(picoquic_stream_head_t* stream)
+{
+    size_t queued_length = 0;
+    picoquic_stream_queue_node_t* next = stream->send_queue;
+
+    while (next != NULL) {
+        queued_length += next->length - (size_t)next->offset;
+        next = next->next_stream_data;
+    }
+    if (stream->cork_node != NULL) {
+        queued_length += stream->cork_node->length;
+    }
+    return queued_length;
+}
+
+static int picoquic_handoff_is_stream_exportable(picoquic_stream_head_t* stream)
+{
+    uint64_t acked_offset = picoquic_handoff_stream_acked_offset(stream);
+
+    return (stream->direct_receive_fn == NULL && stream->reassembly_ring == NULL &&
+        stream->first_deadline == NULL && stream->deadline == 0 && !stream->is_app_flow_controlled &&
+        !stream->reset_requested && !stream->reset_sent && !stream->reset_received &&
+        !stream->stop_sending_requested && !stream->stop_sending_sent && !stream->stop_sending_received &&
+        !stream->is_delivery_queued &&
+        picoquic_stream_copy_retained(stream, acked_offset, NULL, (size_t)(stream->sent_offset - acked_offset)) == 0);
+}
+
+static int picoquic_handoff_is_exportable(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+
+    if (cnx->client_mode || cnx->cnx_state != picoquic_state_ready || !cnx->is_handshake_done_acked ||
+        PICOQUIC_CNX_IS_MULTIPATH(cnx) || cnx->nb_paths != 1 || cnx->path[0]->first_tuple->next_tuple != NULL ||
+        cnx->path[0]->first_tuple->p_local_cnxid == NULL || cnx->path[0]->first_tuple->p_remote_cnxid == NULL ||
+        cnx->nb_crypto_key_rotations != 0 || cnx->key_phase_enc || cnx->key_phase_dec ||
+        cnx->crypto_context_new.aead_encrypt != NULL || cnx->crypto_context_new.aead_decrypt != NULL ||
+        cnx->crypto_context_old.aead_encrypt != NULL || cnx->crypto_context_old.aead_decrypt != NULL ||
+        cnx->is_fec_negotiated || cnx->first_delivery_stream != NULL || cnx->is_hibernating ||
+        picoquic_get_app_cipher_suite_id(cnx) < 0) {
+        ret = PICOQUIC_ERROR_CNX_NOT_EXPORTABLE;
+    }
+    else {
+        picoquic_stream_head_t* stream = picoquic_first_stream(cnx);
+
+        while (ret == 0 && stream != NULL) {
+            if (!picoquic_handoff_is_stream_exportable(stream)) {
+                ret = PICOQUIC_ERROR_CNX_NOT_EXPORTABLE;
+            }
+            stream = picoquic_next_stream(stream);
+        }
+    }
+
+    return ret;
+}
+
+static uint8_t* picoquic_handoff_encode_cnxids(picoquic_cnx_t* cnx, uint8_t* bytes, const uint8_t* bytes_max)
+{
+    picoquic_local_cnxid_list_t* local_cnxid_list = cnx->first_local_cnxid_list;
+    picoquic_remote_cnxid_stash_t* stash = cnx->first_remote_cnxid_stash;
+    picoquic_local_cnxid_t* l_cid;
+    picoquic_remote_cnxid_t* r_cid;
+    uint64_t nb_remote = 0;
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, local_cnxid_list->local_cnxid_sequence_next)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, local_cnxid_list->local_cnxid_retire_before)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, cnx->path[0]->first_tuple->p_local_cnxid->sequence)) != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, (uint64_t)local_cnxid_list->nb_local_cnxid);
+    }
+    l_cid = local_cnxid_list->local_cnxid_first;
+    while (bytes != NULL && l_cid != NULL) {
+        if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, l_cid->sequence)) != NULL &&
+            (bytes = picoquic_frames_cid_encode(bytes, bytes_max, &l_cid->cnx_id)) != NULL) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, l_cid->is_acked);
+        }
+        l_cid = l_cid->next;
+    }
+
+    /* The CIDs whose retirement was acked are gone on the peer side */
+    for (r_cid = stash->cnxid_stash_first; r_cid != NULL; r_cid = r_cid->next) {
+        if (!r_cid->retire_acked) {
+            nb_remote++;
+        }
+    }
+    if (bytes != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, stash->retire_cnxid_before)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, cnx->path[0]->first_tuple->p_remote_cnxid->sequence)) != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, nb_remote);
+    }
+    r_cid = stash->cnxid_stash_first;
+    while (bytes != NULL && r_cid != NULL) {
+        if (!r_cid->retire_acked) {
+            /* A retirement in flight will be repeated */
+            unsigned int needs_removal = r_cid->needs_removal || r_cid->retire_sent;
+
+            if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, r_cid->sequence)) != NULL &&
+                (bytes = picoquic_frames_cid_encode(bytes, bytes_max, &r_cid->cnx_id)) != NULL &&
+                (bytes = picoquic_frames_length_data_encode(bytes, bytes_max, PICOQUIC_RESET_SECRET_SIZE, r_cid->reset_secret)) != NULL) {
+                bytes = picoquic_frames_varint_encode(bytes, bytes_max, needs_removal);
+            }
+        }
+        r_cid = r_cid->next;
+    }
+
+    return bytes;
+}
+
+static uint8_t* picoquic_handoff_encode_app_context(picoquic_cnx_t* cnx, uint8_t* bytes, const uint8_t* bytes_max)
+{
+    picoquic_sack_list_t* sack_list = &cnx->ack_ctx[picoquic_packet_context_application].sack_list;
+    picoquic_sack_item_t* sack = picoquic_sack_first_item(sack_list);
+    picoquic_misc_frame_header_t* misc_frame;
+    uint64_t nb_misc = 0;
+
+    bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_sack_list_size(sack_list));
+    while (bytes != NULL && sack != NULL) {
+        if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_sack_item_range_start(sack))) != NULL) {
+            bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_sack_item_range_end(sack));
+        }
+        sack = picoquic_sack_next_item(sack_list, sack);
+    }
+
+    for (misc_frame = cnx->first_misc_frame; misc_frame != NULL; misc_frame = misc_frame->next_misc_frame) {
+        if (misc_frame->pc == picoquic_packet_context_application) {
+            nb_misc++;
+        }
+    }
+    if (bytes != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, nb_misc);
+    }
+    misc_frame = cnx->first_misc_frame;
+    while (bytes != NULL && misc_frame != NULL) {
+        if (misc_frame->pc == picoquic_packet_context_application) {
+            if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, (uint64_t)misc_frame->is_pure_ack)) != NULL) {
+                bytes = picoquic_frames_length_data_encode(bytes, bytes_max, misc_frame->length,
+                    ((uint8_t*)misc_frame) + sizeof(picoquic_misc_frame_header_t));
+            }
+        }
+        misc_frame = misc_frame->next_misc_frame;
+    }
+
+    return bytes;
+}
+
+static uint8_t* picoquic_handoff_encode_stream(picoquic_stream_head_t* stream, uint8_t* bytes, const uint8_t* bytes_max)
+{
+    uint64_t acked_offset = picoquic_handoff_stream_acked_offset(stream);
+    size_t unacked_length = (size_t)(stream->sent_offset - acked_offset);
+    size_t queued_length = picoquic_handoff_stream_queued_length(stream);
+    uint64_t stream_flags[PICOQUIC_HANDOFF_NB_STREAM_FIELDS];
+    uint64_t stream_values[PICOQUIC_HANDOFF_NB_STREAM_VALUES];
+    uint64_t nb_received = 0;
+    picoquic_stream_data_node_t* data;
+
+    stream_flags[0] = stream->fin_requested;
+    /* The ack of the FIN counts as one more octet, see picoquic_is_stream_acked */
+    stream_flags[1] = stream->fin_sent && picoquic_check_sack_list(&stream->sack_list, 0, stream->sent_offset) != 0;
+    stream_flags[2] = stream->fin_received;
+    stream_flags[3] = stream->fin_signalled;
+    stream_flags[4] = stream->is_active;
+    stream_flags[5] = stream->is_closed;
+    stream_flags[6] = stream->max_stream_updated;
+
+    stream_values[0] = stream->consumed_offset;
+    stream_values[1] = stream->fin_offset;
+    stream_values[2] = stream->maxdata_local;
+    stream_values[3] = stream->maxdata_local_acked;
+    stream_values[4] = stream->maxdata_remote;
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, stream->stream_id)) != NULL &&
+        (bytes = picoquic_frames_uint8_encode(bytes, bytes_max, stream->stream_priority)) != NULL &&
+        (bytes = picoquic_cc_snapshot_encode(bytes, bytes_max, stream_flags, PICOQUIC_HANDOFF_NB_STREAM_FIELDS)) != NULL &&
+        (bytes = picoquic_cc_snapshot_encode(bytes, bytes_max, stream_values, PICOQUIC_HANDOFF_NB_STREAM_VALUES)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, acked_offset)) != NULL &&
+        (bytes = picoquic_frames_varlen_encode(bytes, bytes_max, unacked_length + queued_length)) != NULL) {
+        /* The unacked data and the queued data are contiguous, and are copied in a single run */
+        if ((size_t)(bytes_max - bytes) < unacked_length + queued_length ||
+            picoquic_stream_copy_retained(stream, acked_offset, bytes, unacked_length) != 0) {
+            bytes = NULL;
+        }
+        else {
+            picoquic_stream_queue_node_t* next = stream->send_queue;
+
+            bytes += unacked_length;
+            while (next != NULL) {
+                memcpy(bytes, next->bytes + next->offset, next->length - (size_t)next->offset);
+                bytes += next->length - (size_t)next->offset;
+                next = next->next_stream_data;
+            }
+            if (stream->cork_node != NULL && stream->cork_node->length > 0) {
+                memcpy(bytes, stream->cork_node->bytes, stream->cork_node->length);
+                bytes += stream->cork_node->length;
+            }
+        }
+    }
+
+    /* Data received out of order, above the consumed offset */
+    for (data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree); data != NULL;
+        data = (picoquic_stream_data_node_t*)picosplay_next(&data->stream_data_node)) {
+        if (data->offset + data->length > stream->consumed_offset) {
+            nb_received++;
+        }
+    }
+    if (bytes != NULL) {
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, nb_received);
+    }
+    for (data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree); bytes != NULL && data != NULL;
+        data = (picoquic_stream_data_node_t*)picosplay_next(&data->stream_data_node)) {
+        if (data->offset + data->length > stream->consumed_offset) {
+            size_t start = (data->offset < stream->consumed_offset) ? (size_t)(stream->consumed_offset - data->offset) : 0;
+
+            if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, data->offset + start)) != NULL) {
+                bytes = picoquic_frames_length_data_encode(bytes, bytes_max, data->length - start, data->bytes + start);
+            }
+        }
+    }
+
+    return bytes;
+}
+
+int picoquic_export_cnx(picoquic_cnx_t* cnx, uint8_t* bytes, size_t bytes_max, size_t* length, uint64_t current_time)
+{
+    int ret = picoquic_handoff_is_exportable(cnx);
+    uint8_t* bytes_next = bytes;
+    uint8_t* bytes_end = bytes + bytes_max;
+
+    *length = 0;
+
+    if (ret == 0) {
+        picoquic_path_t* path_x = cnx->path[0];
+        picoquic_tuple_t* tuple = path_x->first_tuple;
+        size_t secret_length = picoquic_get_app_secret_size(cnx);
+        uint64_t* fields[PICOQUIC_HANDOFF_CNX_FIELDS_MAX];
+        uint64_t values[PICOQUIC_HANDOFF_CNX_FIELDS_MAX];
+        uint64_t scalars[PICOQUIC_HANDOFF_NB_SCALARS];
+        uint64_t rewind = 0;
+        size_t nb_fields = picoquic_handoff_cnx_fields(cnx, fields);
+        picoquic_stream_head_t* stream;
+        uint8_t cc_snapshot[PICOQUIC_CC_SNAPSHOT_MAX];
+        size_t cc_length = 0;
+        uint64_t nb_streams = 0;
+
+        for (stream = picoquic_first_stream(cnx); stream != NULL; stream = picoquic_next_stream(stream)) {
+            rewind += stream->sent_offset - picoquic_handoff_stream_acked_offset(stream);
+            nb_streams++;
+        }
+
+        scalars[0] = picoquic_supported_versions[cnx->version_index].version;
+        scalars[1] = (current_time > cnx->start_time) ? current_time - cnx->start_time : 0;
+        scalars[2] = picoquic_handoff_get_flags(cnx);
+        scalars[3] = cnx->data_sent - rewind;
+        scalars[4] = path_x->send_mtu;
+        scalars[5] = path_x->send_mtu_max_tried;
+        scalars[6] = cnx->ack_ctx[picoquic_packet_context_application].sending_ecn_ack;
+        for (size_t i = 0; i < nb_fields; i++) {
+            values[i] = *fields[i];
+        }
+
+        if (picoquic_export_path_cc_state(cnx, 0, cc_snapshot, sizeof(cc_snapshot), &cc_length, current_time) != 0) {
+            /* The congestion control restarts from scratch */
+            cc_length = 0;
+        }
+
+        if ((bytes_next = picoquic_frames_varint_encode(bytes_next, bytes_end, PICOQUIC_HANDOFF_VERSION)) != NULL &&
+            (bytes_next = picoquic_cc_snapshot_encode(bytes_next, bytes_end, scalars, PICOQUIC_HANDOFF_NB_SCALARS)) != NULL &&
+            (bytes_next = picoquic_frames_varint_encode(bytes_next, bytes_end, nb_fields)) != NULL &&
+            (bytes_next = picoquic_cc_snapshot_encode(bytes_next, bytes_end, values, nb_fields)) != NULL) {
+            picoquic_handoff_get_tp(&cnx->local_parameters, values);
+            bytes_next = picoquic_cc_snapshot_encode(bytes_next, bytes_end, values, PICOQUIC_HANDOFF_NB_TP_VALUES);
+        }
+        if (bytes_next != NULL) {
+            picoquic_handoff_get_tp(&cnx->remote_parameters, values);
+            if ((bytes_next = picoquic_cc_snapshot_encode(bytes_next, bytes_end, values, PICOQUIC_HANDOFF_NB_TP_VALUES)) != NULL &&
+                (bytes_next = picoquic_frames_cid_encode(bytes_next, bytes_end, &cnx->initial_cnxid)) != NULL &&
+                (bytes_next = picoquic_frames_cid_encode(bytes_next, bytes_end, &cnx->original_cnxid)) != NULL &&
+                (bytes_next = picoquic_frames_charz_encode(bytes_next, bytes_end, cnx->sni)) != NULL &&
+                (bytes_next = picoquic_frames_charz_encode(bytes_next, bytes_end, cnx->alpn)) != NULL &&
+                (bytes_next = picoquic_frames_varint_encode(bytes_next, bytes_end, (uint64_t)picoquic_get_app_cipher_suite_id(cnx))) != NULL &&
+                (bytes_next = picoquic_frames_length_data_encode(bytes_next, bytes_end, secret_length, picoquic_get_app_secret(cnx, 1))) != NULL &&
+                (bytes_next = picoquic_frames_length_data_encode(bytes_next, bytes_end, secret_length, picoquic_get_app_secret(cnx, 0))) != NULL &&
+                (bytes_next = picoquic_handoff_addr_encode(bytes_next, bytes_end, &tuple->peer_addr)) != NULL &&
+                (bytes_next = picoquic_handoff_addr_encode(bytes_next, bytes_end, &tuple->local_addr)) != NULL &&
+                (bytes_next = picoquic_handoff_encode_cnxids(cnx, bytes_next, bytes_end)) != NULL &&
+                (bytes_next = picoquic_handoff_encode_app_context(cnx, bytes_next, bytes_end)) != NULL &&
+                (bytes_next = picoquic_frames_length_data_encode(bytes_next, bytes_end, cc_length, cc_snapshot)) != NULL) {
+                bytes_next = picoquic_frames_varint_encode(bytes_next, bytes_end, nb_streams);
+            }
+        }
+        for (stream = picoquic_first_stream(cnx); bytes_next != NULL && stream != NULL; stream = picoquic_next_stream(stream)) {
+            bytes_next = picoquic_handoff_encode_stream(stream, bytes_next, bytes_end);
+        }
+
+        if (bytes_next == NULL) {
+            ret = PICOQUIC_ERROR_FRAME_BUFFER_TOO_SMALL;
+        }
+        else {
+            *length = bytes_next - bytes;
+        }
+    }
+
+    return ret;
+}
+
+static const uint8_t* picoquic_handoff_decode_cnxids(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t current_time, int* ret)
+{
+    picoquic_local_cnxid_list_t* local_cnxid_list = cnx->first_local_cnxid_list;
+    picoquic_remote_cnxid_stash_t* stash = cnx->first_remote_cnxid_stash;
+    picoquic_tuple_t* tuple = cnx->path[0]->first_tuple;
+    uint64_t sequence_next = 0;
+    uint64_t retire_before = 0;
+    uint64_t path_sequence = 0;
+    uint64_t nb_cid = 0;
+
+    /* Replace the CIDs created with the connection by those of the old server */
+    while (local_cnxid_list->local_cnxid_first != NULL) {
+        picoquic_delete_local_cnxid(cnx, local_cnxid_list->local_cnxid_first);
+    }
+    cnx->path[0]->was_local_cnxid_retired = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &sequence_next)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &retire_before)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &path_sequence)) != NULL) {
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_cid);
+    }
+    for (uint64_t i = 0; bytes != NULL && *ret == 0 && i < nb_cid; i++) {
+        uint64_t sequence = 0;
+        uint64_t is_acked = 0;
+        picoquic_connection_id_t cnx_id;
+        picoquic_local_cnxid_t* l_cid;
+
+        if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &sequence)) != NULL &&
+            (bytes = picoquic_frames_cid_decode(bytes, bytes_max, &cnx_id)) != NULL &&
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &is_acked)) != NULL) {
+            if (cnx_id.id_len != cnx->quic->local_cnxid_length) {
+                *ret = PICOQUIC_ERROR_CNXID_CHECK;
+            }
+            else {
+                local_cnxid_list->local_cnxid_sequence_next = sequence;
+                if ((l_cid = picoquic_create_local_cnxid(cnx, 0, &cnx_id, current_time)) == NULL) {
+                    *ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else if (picoquic_compare_connection_id(&l_cid->cnx_id, &cnx_id) != 0) {
+                    /* The CID is already used by another connection of this server */
+                    *ret = PICOQUIC_ERROR_CNXID_CHECK;
+                }
+                else {
+                    l_cid->is_acked = (is_acked != 0);
+                    if (sequence == path_sequence) {
+                        tuple->p_local_cnxid = l_cid;
+                    }
+                }
+            }
+        }
+    }
+
+    if (bytes != NULL && *ret == 0) {
+        picoquic_remote_cnxid_t* r_cid = stash->cnxid_stash_first;
+        uint64_t stash_retire_before = 0;
+
+        local_cnxid_list->local_cnxid_sequence_next = sequence_next;
+        local_cnxid_list->local_cnxid_retire_before = retire_before;
+        local_cnxid_list->local_cnxid_oldest_created = current_time;
+        local_cnxid_list->nb_local_cnxid_expired = 0;
+        for (picoquic_local_cnxid_t* l_cid = local_cnxid_list->local_cnxid_first; l_cid != NULL; l_cid = l_cid->next) {
+            if (l_cid->sequence < retire_before) {
+                local_cnxid_list->nb_local_cnxid_expired++;
+            }
+        }
+        if (tuple->p_local_cnxid == NULL) {
+            *ret = PICOQUIC_ERROR_CNXID_CHECK;
+        }
+
+        /* The remote CID set by picoquic_create_cnx is replaced as well */
+        while (r_cid != NULL) {
+            r_cid->nb_path_references = 0;
+            r_cid = picoquic_remove_cnxid_from_stash(cnx, stash, r_cid, NULL);
+        }
+        tuple->p_remote_cnxid = NULL;
+
+        if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &stash_retire_before)) != NULL &&
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &path_sequence)) != NULL) {
+            bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_cid);
+        }
+        for (uint64_t i = 0; bytes != NULL && *ret == 0 && i < nb_cid; i++) {
+            uint64_t sequence = 0;
+            uint64_t needs_removal = 0;
+            picoquic_connection_id_t cnx_id;
+            const uint8_t* secret = NULL;
+            size_t secret_length = 0;
+
+            if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &sequence)) != NULL &&
+                (bytes = picoquic_frames_cid_decode(bytes, bytes_max, &cnx_id)) != NULL &&
+                (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &secret, &secret_length)) != NULL &&
+                (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &needs_removal)) != NULL) {
+                if (secret_length != PICOQUIC_RESET_SECRET_SIZE) {
+                    bytes = NULL;
+                }
+                else if ((r_cid = picoquic_append_remote_cnxid_to_stash(cnx, stash, sequence, &cnx_id, secret)) == NULL) {
+                    *ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    r_cid->needs_removal = (needs_removal != 0);
+                    if (sequence == path_sequence) {
+                        tuple->p_remote_cnxid = r_cid;
+                        r_cid->nb_path_references++;
+                    }
+                }
+            }
+        }
+        if (bytes != NULL && *ret == 0) {
+            stash->retire_cnxid_before = stash_retire_before;
+            if (tuple->p_remote_cnxid == NULL) {
+                *ret = PICOQUIC_ERROR_CNXID_CHECK;
+            }
+            else if (picoquic_remove_not_before_from_stash(cnx, stash, stash_retire_before, current_time) != 0 ||
+                picoquic_register_net_secret(cnx) != 0) {
+                *ret = PICOQUIC_ERROR_MEMORY;
+            }
+        }
+    }
+
+    return bytes;
+}
+
+static const uint8_t* picoquic_handoff_decode_app_context(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t current_time, int* ret)
+{
+    picoquic_sack_list_t* sack_list = &cnx->ack_ctx[picoquic_packet_context_application].sack_list;
+    uint64_t nb_ranges = 0;
+    uint64_t nb_misc = 0;
+
+    bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_ranges);
+    for (uint64_t i = 0; bytes != NULL && *ret == 0 && i < nb_ranges; i++) {
+        uint64_t range[2];
+
+        if ((bytes = picoquic_frames_varint_decode_batch(bytes, bytes_max, range, 2)) != NULL) {
+            if (range[1] < range[0]) {
+                bytes = NULL;
+            }
+            else {
+                *ret = picoquic_update_sack_list(sack_list, range[0], range[1], current_time);
+            }
+        }
+    }
+
+    if (bytes != NULL) {
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_misc);
+    }
+    for (uint64_t i = 0; bytes != NULL && *ret == 0 && i < nb_misc; i++) {
+        uint64_t is_pure_ack = 0;
+        const uint8_t* frame = NULL;
+        size_t frame_length = 0;
+
+        if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &is_pure_ack)) != NULL &&
+            (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &frame, &frame_length)) != NULL) {
+            *ret = picoquic_queue_misc_frame(cnx, frame, frame_length, (int)is_pure_ack, picoquic_packet_context_application);
+        }
+    }
+
+    return bytes;
+}
+
+static const uint8_t* picoquic_handoff_decode_stream(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max, int* ret)
+{
+    uint64_t stream_id = 0;
+    uint8_t stream_priority = 0;
+    uint64_t stream_flags[PICOQUIC_HANDOFF_NB_STREAM_FIELDS];
+    uint64_t stream_values[PICOQUIC_HANDOFF_NB_STREAM_VALUES];
+    uint64_t acked_offset = 0;
+    const uint8_t* data = NULL;
+    size_t data_length = 0;
+    uint64_t nb_received = 0;
+    picoquic_stream_head_t* stream = NULL;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &stream_id)) != NULL &&
+        (bytes = picoquic_frames_uint8_decode(bytes, bytes_max, &stream_priority)) != NULL &&
+        (bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, stream_flags, PICOQUIC_HANDOFF_NB_STREAM_FIELDS)) != NULL &&
+        (bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, stream_values, PICOQUIC_HANDOFF_NB_STREAM_VALUES)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &acked_offset)) != NULL &&
+        (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &data, &data_length)) != NULL) {
+        if ((stream = picoquic_find_stream(cnx, stream_id)) == NULL &&
+            (stream = picoquic_create_stream(cnx, stream_id)) == NULL) {
+            *ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            stream->stream_priority = stream_priority;
+            if (stream->is_output_stream) {
+                picoquic_reorder_output_stream(cnx, stream);
+            }
+            stream->consumed_offset = stream_values[0];
+            stream->fin_offset = stream_values[1];
+            stream->maxdata_local = stream_values[2];
+            stream->maxdata_local_acked = stream_values[3];
+            stream->maxdata_remote = stream_values[4];
+            stream->fin_received = (stream_flags[2] != 0);
+            stream->fin_signalled = (stream_flags[3] != 0);
+            stream->max_stream_updated = (stream_flags[6] != 0);
+            stream->sent_offset = acked_offset;
+            /* Data in flight is sent again, starting from the acknowledged prefix */
+            if (stream_flags[1]) {
+                *ret = picoquic_update_sack_list(&stream->sack_list, 0, acked_offset, 0);
+                stream->fin_requested = 1;
+                stream->fin_sent = 1;
+            }
+            else {
+                if (acked_offset > 0) {
+                    *ret = picoquic_update_sack_list(&stream->sack_list, 0, acked_offset - 1, 0);
+                }
+                if (*ret == 0 && (data_length > 0 || stream_flags[0])) {
+                    *ret = picoquic_add_to_stream_with_ctx(cnx, stream_id, data, data_length, (int)stream_flags[0], NULL);
+                }
+            }
+            if (*ret == 0 && stream_flags[4]) {
+                *ret = picoquic_mark_active_stream(cnx, stream_id, 1, NULL);
+            }
+            stream->is_closed = (stream_flags[5] != 0);
+        }
+    }
+
+    if (bytes != NULL) {
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_received);
+    }
+    for (uint64_t i = 0; bytes != NULL && *ret == 0 && i < nb_received; i++) {
+        uint64_t offset = 0;
+        int new_data_available = 0;
+
+        if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &offset)) != NULL &&
+            (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &data, &data_length)) != NULL) {
+            *ret = picoquic_queue_network_input(cnx->quic, cnx, &stream->stream_data_tree, stream->consumed_offset,
+                offset, data, data_length, 0, NULL, &new_data_available);
+        }
+    }
+
+    return bytes;
+}
+
+/* The flow control updates that the peer did not acknowledge are sent again */
+static int picoquic_handoff_queue_flow_control(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+    uint8_t frame[PICOQUIC_HANDOFF_FRAME_MAX];
+    uint8_t* bytes_next;
+    picoquic_stream_head_t* stream;
+
+    if (cnx->maxdata_local > cnx->maxdata_local_acked) {
+        if ((bytes_next = picoquic_frames_uint8_encode(frame, frame + sizeof(frame), picoquic_frame_type_max_data)) != NULL &&
+            (bytes_next = picoquic_frames_varint_encode(bytes_next, frame + sizeof(frame), cnx->maxdata_local)) != NULL) {
+            ret = picoquic_queue_misc_frame(cnx, frame, bytes_next - frame, 0, picoquic_packet_context_application);
+        }
+    }
+    for (stream = picoquic_first_stream(cnx); ret == 0 && stream != NULL; stream = picoquic_next_stream(stream)) {
+        if (!stream->fin_received && stream->maxdata_local > stream->maxdata_local_acked &&
+            (bytes_next = picoquic_frames_uint8_encode(frame, frame + sizeof(frame), picoquic_frame_type_max_stream_data)) != NULL &&
+            (bytes_next = picoquic_frames_varint_encode(bytes_next, frame + sizeof(frame), stream->stream_id)) != NULL &&
+            (bytes_next = picoquic_frames_varint_encode(bytes_next, frame + sizeof(frame), stream->maxdata_local)) != NULL) {
+            ret = picoquic_queue_misc_frame(cnx, frame, bytes_next - frame, 0, picoquic_packet_context_application);
+        }
+    }
+    if (ret == 0 && STREAM_RANK_FROM_ID(cnx->max_stream_id_bidir_local) > cnx->max_stream_id_bidir_rank_acked &&
+        (bytes_next = picoquic_frames_uint8_encode(frame, frame + sizeof(frame), picoquic_frame_type_max_streams_bidir)) != NULL &&
+        (bytes_next = picoquic_frames_varint_encode(bytes_next, frame + sizeof(frame), STREAM_RANK_FROM_ID(cnx->max_stream_id_bidir_local))) != NULL) {
+        ret = picoquic_queue_misc_frame(cnx, frame, bytes_next - frame, 0, picoquic_packet_context_application);
+    }
+    if (ret == 0 && STREAM_RANK_FROM_ID(cnx->max_stream_id_unidir_local) > cnx->max_stream_id_unidir_rank_acked &&
+        (bytes_next = picoquic_frames_uint8_encode(frame, frame + sizeof(frame), picoquic_frame_type_max_streams_unidir)) != NULL &&
+        (bytes_next = picoquic_frames_varint_encode(bytes_next, frame + sizeof(frame), STREAM_RANK_FROM_ID(cnx->max_stream_id_unidir_local))) != NULL) {
+        ret = picoquic_queue_misc_frame(cnx, frame, bytes_next - frame, 0, picoquic_packet_context_application);
+    }
+
+    return ret;
+}
+
+/* The NEW_CONNECTION_ID frames that the peer did not acknowledge are sent again */
+static int picoquic_handoff_queue_new_cnxids(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+    picoquic_local_cnxid_list_t* local_cnxid_list = cnx->first_local_cnxid_list;
+    uint8_t frame[PICOQUIC_HANDOFF_FRAME_MAX];
+
+    for (picoquic_local_cnxid_t* l_cid = local_cnxid_list->local_cnxid_first; ret == 0 && l_cid != NULL; l_cid = l_cid->next) {
+        if (!l_cid->is_acked && l_cid != cnx->path[0]->first_tuple->p_local_cnxid) {
+            int more_data = 0;
+            int is_pure_ack = 1;
+            uint8_t* bytes_next = picoquic_format_new_connection_id_frame(cnx, local_cnxid_list, frame, frame + sizeof(frame),
+                &more_data, &is_pure_ack, l_cid);
+
+            if (bytes_next > frame) {
+                ret = picoquic_queue_misc_frame(cnx, frame, bytes_next - frame, is_pure_ack, picoquic_packet_context_application);
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Set the connection in the state reached at the end of the handshake, as in picoquic_ready_state_transition */
+static void picoquic_handoff_set_ready(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_quic_t* quic = cnx->quic;
+
+    cnx->cnx_state = picoquic_state_ready;
+    cnx->is_handshake_finished = 1;
+    cnx->is_handshake_done_acked = 1;
+    cnx->remote_parameters_received = 1;
+    cnx->initial_validated = 1;
+    if (cnx->is_half_open) {
+        if (quic->current_number_half_open > 0) {
+            quic->current_number_half_open--;
+        }
+        cnx->is_half_open = 0;
+        if (quic->current_number_half_open < quic->max_half_open_before_retry) {
+            quic->check_token = quic->force_check_token;
+        }
+    }
+    picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_initial]);
+    picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_0rtt]);
+    picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_handshake]);
+    picoquic_tlscontext_trim_after_handshake(cnx);
+    if (cnx->crypto_epoch_length_max == 0) {
+        cnx->crypto_epoch_length_max =
+            picoquic_aead_confidentiality_limit(cnx->crypto_context[picoquic_epoch_1rtt].aead_decrypt);
+    }
+    cnx->latest_receive_time = current_time;
+    cnx->latest_progress_time = current_time;
+}
+
+int picoquic_import_cnx(picoquic_quic_t* quic, const uint8_t* bytes, size_t length, uint64_t current_time,
+    picoquic_cnx_t** p_cnx)
+{
+    int ret = 0;
+    const uint8_t* bytes_max = bytes + length;
+    uint64_t version = 0;
+    uint64_t scalars[PICOQUIC_HANDOFF_NB_SCALARS];
+    uint64_t nb_fields = 0;
+    uint64_t values[PICOQUIC_HANDOFF_CNX_FIELDS_MAX];
+    uint64_t local_tp[PICOQUIC_HANDOFF_NB_TP_VALUES];
+    uint64_t remote_tp[PICOQUIC_HANDOFF_NB_TP_VALUES];
+    picoquic_connection_id_t initial_cnxid;
+    picoquic_connection_id_t original_cnxid;
+    char sni[PICOQUIC_HANDOFF_NAME_MAX];
+    char alpn[PICOQUIC_HANDOFF_NAME_MAX];
+    uint64_t cipher_suite_id = 0;
+    const uint8_t* secret_enc = NULL;
+    const uint8_t* secret_dec = NULL;
+    size_t secret_enc_length = 0;
+    size_t secret_dec_length = 0;
+    struct sockaddr_storage peer_addr;
+    struct sockaddr_storage local_addr;
+    picoquic_cnx_t* cnx = NULL;
+
+    *p_cnx = NULL;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &version)) == NULL || version != PICOQUIC_HANDOFF_VERSION ||
+        (bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, scalars, PICOQUIC_HANDOFF_NB_SCALARS)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_fields)) == NULL || nb_fields > PICOQUIC_HANDOFF_CNX_FIELDS_MAX ||
+        (bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, (size_t)nb_fields)) == NULL ||
+        (bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, local_tp, PICOQUIC_HANDOFF_NB_TP_VALUES)) == NULL ||
+        (bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, remote_tp, PICOQUIC_HANDOFF_NB_TP_VALUES)) == NULL ||
+        (bytes = picoquic_frames_cid_decode(bytes, bytes_max, &initial_cnxid)) == NULL ||
+        (bytes = picoquic_frames_cid_decode(bytes, bytes_max, &original_cnxid)) == NULL ||
+        (bytes = picoquic_handoff_name_decode(bytes, bytes_max, sni)) == NULL ||
+        (bytes = picoquic_handoff_name_decode(bytes, bytes_max, alpn)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &cipher_suite_id)) == NULL ||
+        (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &secret_enc, &secret_enc_length)) == NULL ||
+        (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &secret_dec, &secret_dec_length)) == NULL ||
+        secret_enc_length != secret_dec_length || cipher_suite_id > UINT16_MAX ||
+        (bytes = picoquic_handoff_addr_decode(bytes, bytes_max, &peer_addr)) == NULL ||
+        (bytes = picoquic_handoff_addr_decode(bytes, bytes_max, &local_addr)) == NULL ||
+        peer_addr.ss_family == 0) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else if (picoquic_get_version_index((uint32_t)scalars[0]) < 0) {
+        ret = PICOQUIC_ERROR_VERSION_NOT_SUPPORTED;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, initial_cnxid, picoquic_null_connection_id, (struct sockaddr*)&peer_addr,
+        (current_time > scalars[1]) ? current_time - scalars[1] : 0, (uint32_t)scalars[0],
+        (sni[0] == 0) ? NULL : sni, (alpn[0] == 0) ? NULL : alpn, 0)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        uint64_t* fields[PICOQUIC_HANDOFF_CNX_FIELDS_MAX];
+        uint8_t cc_snapshot[PICOQUIC_CC_SNAPSHOT_MAX];
+        const uint8_t* cc_bytes = NULL;
+        size_t cc_length = 0;
+        uint64_t nb_streams = 0;
+
+        if (picoquic_handoff_cnx_fields(cnx, fields) != nb_fields) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else {
+            for (size_t i = 0; i < nb_fields; i++) {
+                *fields[i] = values[i];
+            }
+            picoquic_handoff_set_tp(&cnx->local_parameters, local_tp);
+            picoquic_handoff_set_tp(&cnx->remote_parameters, remote_tp);
+            picoquic_handoff_set_flags(cnx, scalars[2]);
+            cnx->original_cnxid = original_cnxid;
+            cnx->path[0]->send_mtu = (size_t)scalars[4];
+            cnx->path[0]->send_mtu_max_tried = (size_t)scalars[5];
+            cnx->ack_ctx[picoquic_packet_context_application].sending_ecn_ack = (scalars[6] != 0);
+            picoquic_store_addr(&cnx->path[0]->first_tuple->local_addr, (struct sockaddr*)&local_addr);
+
+            if (picoquic_import_app_traffic_secrets(cnx, (int)cipher_suite_id, secret_enc, secret_dec, secret_enc_length) != 0) {
+                ret = PICOQUIC_ERROR_CANNOT_COMPUTE_KEY;
+            }
+        }
+
+        if (ret == 0 &&
+            ((bytes = picoquic_handoff_decode_cnxids(cnx, bytes, bytes_max, current_time, &ret)) == NULL ||
+            (ret == 0 && (bytes = picoquic_handoff_decode_app_context(cnx, bytes, bytes_max, current_time, &ret)) == NULL) ||
+            (ret == 0 && (bytes = picoquic_handoff_data_decode(bytes, bytes_max, &cc_bytes, &cc_length)) == NULL) ||
+            (ret == 0 && (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &nb_streams)) == NULL))) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        for (uint64_t i = 0; ret == 0 && i < nb_streams; i++) {
+            if ((bytes = picoquic_handoff_decode_stream(cnx, bytes, bytes_max, &ret)) == NULL) {
+                ret = PICOQUIC_ERROR_INVALID_FILE;
+            }
+        }
+
+        if (ret == 0) {
+            /* The resent stream data was already counted for flow control */
+            cnx->data_sent = scalars[3];
+            if (cc_length > 0 && cc_length <= sizeof(cc_snapshot)) {
+                int cc_ret;
+
+                memcpy(cc_snapshot, cc_bytes, cc_length);
+                cc_ret = picoquic_import_path_cc_state(cnx, 0, cc_snapshot, cc_length, current_time);
+                if (cc_ret != 0 && cc_ret != PICOQUIC_ERROR_CC_SNAPSHOT_MISMATCH) {
+                    ret = cc_ret;
+                }
+            }
+        }
+        if (ret == 0 && (ret = picoquic_handoff_queue_new_cnxids(cnx)) == 0 &&
+            (ret = picoquic_handoff_queue_flow_control(cnx)) == 0) {
+            picoquic_handoff_set_ready(cnx, current_time);
+            picoquic_reinsert_by_wake_time(quic, cnx, current_time);
+            *p_cnx = cnx;
+        }
+        else {
+            picoquic_delete_cnx(cnx);
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,194 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Connection statistics snapshots.
+*
+* Reading the connection or path state from another thread is not safe,
+* since the network thread updates it while processing packets. When
+* enabled, each connection keeps a small block of statistics that the
+* network thread publishes at most once per interval, when it prepares
+* packets for the connection. Monitoring threads can copy the latest
+* publication at any time, without locks and without waking up the
+* network thread.
+*
+* The block holds two slots, protected by sequence numbers as in
+* cc_telemetry.c. Publication n is written in slot n % 2: the writer sets
+* the slot sequence to 2*n+1, copies the statistics, sets the sequence to
+* 2*(n+1), and then sets the number of publications to n+1. A reader copies
+* the slot of the last publication, and retries if the sequence changed
+* during the copy. Since the writer alternates slots, the reader only
+* retries if it is slower than a full publication interval.
+*
+* The block is reference counted, like the telemetry rings: the connection
+* holds one reference, and each handle obtained with picoquic_get_cnx_stats
+* holds another. The last statistics are published when the connection is
+* deleted, and remain readable until the last handle is released.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+#define PICOQUIC_CNX_STATS_READ_ATTEMPTS 8
+
+typedef struct st_picoquic_cnx_stats_slot_t {
+    volatile uint64_t seq;
+    picoquic_cnx_stats_t stats;
+} picoquic_cnx_stats_slot_t;
+
+struct st_picoquic_cnx_stats_block_t {
+    volatile uint32_t ref_count;
+    volatile uint32_t is_closed;
+    volatile uint64_t nb_published;
+    uint64_t publish_interval;
+    uint64_t next_publish_time;
+    picoquic_cnx_stats_slot_t slot[2];
+};
+
+void picoquic_set_default_cnx_stats_interval(picoquic_quic_t* quic, uint64_t publish_interval)
+{
+    quic->cnx_stats_interval = publish_interval;
+}
+
+void picoquic_cnx_stats_attach(picoquic_cnx_t* cnx)
+{
+    if (cnx->quic->cnx_stats_interval > 0 && cnx->stats_block == NULL) {
+        picoquic_cnx_stats_block_t* block = (picoquic_cnx_stats_block_t*)malloc(sizeof(picoquic_cnx_stats_block_t));
+
+        if (block == NULL) {
+            DBG_PRINTF("%s", "Cannot allocate connection statistics block");
+        }
+        else {
+            memset(block, 0, sizeof(picoquic_cnx_stats_block_t));
+            block->ref_count = 1;
+            block->publish_interval = cnx->quic->cnx_stats_interval;
+            cnx->stats_block = block;
+        }
+    }
+}
+
+static void picoquic_cnx_stats_publish(picoquic_cnx_t* cnx, picoquic_cnx_stats_block_t* block, uint64_t current_time)
+{
+    uint64_t n = block->nb_published;
+    picoquic_cnx_stats_slot_t* slot = &block->slot[n % 2];
+    picoquic_cnx_stats_t* stats = &slot->stats;
+
+    PICOQUIC_TELEMETRY_STORE64(&slot->seq, 2 * n + 1);
+    PICOQUIC_TELEMETRY_WRITE_FENCE();
+
+    stats->sequence = n + 1;
+    stats->publish_time = current_time;
+    stats->cnx_state = (uint64_t)cnx->cnx_state;
+    stats->nb_paths = (uint64_t)cnx->nb_paths;
+    stats->data_sent = cnx->data_sent;
+    stats->data_received = cnx->data_received;
+    stats->nb_packets_sent = cnx->nb_packets_sent;
+    stats->nb_packets_received = cnx->nb_packets_received;
+    stats->nb_retransmission_total = cnx->nb_retransmission_total;
+    stats->nb_spurious = cnx->nb_spurious;
+    stats->send_backlog = cnx->send_backlog;
+    if (cnx->nb_paths > 0 && cnx->path[0] != NULL) {
+        picoquic_copy_path_quality(cnx->path[0], &stats->default_path);
+    }
+    else {
+        memset(&stats->default_path, 0, sizeof(picoquic_path_quality_t));
+    }
+
+    PICOQUIC_TELEMETRY_STORE64(&slot->seq, 2 * (n + 1));
+    PICOQUIC_TELEMETRY_STORE64(&block->nb_published, n + 1);
+    block->next_publish_time = current_time + block->publish_interval;
+}
+
+/* Called by the network thread after preparing packets for the connection. */
+void picoquic_cnx_stats_record(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_cnx_stats_block_t* block = cnx->stats_block;
+
+    if (block != NULL && current_time >= block->next_publish_time) {
+        picoquic_cnx_stats_publish(cnx, block, current_time);
+    }
+}
+
+void picoquic_cnx_stats_detach(picoquic_cnx_t* cnx)
+{
+    picoquic_cnx_stats_block_t* block = cnx->stats_block;
+
+    if (block != NULL) {
+        picoquic_cnx_stats_publish(cnx, block, picoquic_get_quic_time(cnx->quic));
+        PICOQUIC_TELEMETRY_STORE32(&block->is_closed, 1);
+        cnx->stats_block = NULL;
+        picoquic_release_cnx_stats(block);
+    }
+}
+
+picoquic_cnx_stats_block_t* picoquic_get_cnx_stats(picoquic_cnx_t* cnx)
+{
+    picoquic_cnx_stats_block_t* block = cnx->stats_block;
+
+    if (block != NULL) {
+        (void)PICOQUIC_TELEMETRY_INCREF(&block->ref_count);
+    }
+
+    return block;
+}
+
+void picoquic_release_cnx_stats(picoquic_cnx_stats_block_t* block)
+{
+    if (block != NULL && PICOQUIC_TELEMETRY_DECREF(&block->ref_count) == 0) {
+        free(block);
+    }
+}
+
+int picoquic_cnx_stats_is_closed(picoquic_cnx_stats_block_t* block)
+{
+    return (int)PICOQUIC_TELEMETRY_LOAD32(&block->is_closed);
+}
+
+/* Called by any thread. Returns -1 if nothing was published yet, or if
+ * the publications were too frequent to obtain a consistent copy. */
+int picoquic_read_cnx_stats(picoquic_cnx_stats_block_t* block, picoquic_cnx_stats_t* stats)
+{
+    int ret = -1;
+
+    for (int i = 0; ret != 0 && i < PICOQUIC_CNX_STATS_READ_ATTEMPTS; i++) {
+        uint64_t n = PICOQUIC_TELEMETRY_LOAD64(&block->nb_published);
+        picoquic_cnx_stats_slot_t* slot;
+
+        if (n == 0) {
+            break;
+        }
+        slot = &block->slot[(n - 1) % 2];
+        if (PICOQUIC_TELEMETRY_LOAD64(&slot->seq) == 2 * n) {
+            memcpy(stats, (const void*)&slot->stats, sizeof(picoquic_cnx_stats_t));
+            PICOQUIC_TELEMETRY_READ_FENCE();
+            if (PICOQUIC_TELEMETRY_LOAD64(&slot->seq) == 2 * n) {
+                ret = 0;
+            }
+        }
+    }
+
+    return ret;
+}
@@ -104,6 +104,11 @@ static option_table_line_t option_table[] = {
     { picoquic_option_ECH_server, 'E' , "ech_s", 2, "key config", "ECH private key file, config file. Default= no ECH on server."},
     { picoquic_option_ECH_init, 'y', "ech_init", 1, "public_name", "Create an ECH configuration before applying the `ech_s` parameter."},
     { picoquic_option_ECH_client, 'K', "ech_c", 1, "base64", "ECH configuration for the client connection, base64 encoded,"},
+    { picoquic_option_Packet_Pool, 0, "packet_pool", 1, "number", "Number of free packets kept for reuse. Default=8192" },
+    { picoquic_option_Data_Node_Pool, 0, "data_node_pool", 1, "number", "Number of free stream data nodes kept for reuse. Default=8192" },
+    { picoquic_option_Recv_Batch, 0, "recv_batch", 1, "number", "Packets received per packet loop iteration, up to 64. Default=10" },
+    { picoquic_option_Send_Batch, '4', "send_batch", 1, "number", "Packets sent per packet loop iteration, up to 64. Default=10" },
+    { picoquic_option_Path_Target, '5', "path_target", 1, "number", "Max simultaneous paths per connection. Default=8" },
     { picoquic_option_HELP, 'h', "help", 0, "", "This help message" }
 };
 
@@ -347,7 +352,7 @@ static int config_set_option(option_table_line_t* option_desc, option_param_t* p
         break;
     case picoquic_option_MTU_MAX:
         config->mtu_max = config_atoi(params, nb_params, 0, &ret);
-        if (config->mtu_max <= 0 || config->mtu_max > PICOQUIC_MAX_PACKET_SIZE) {
+        if (config->mtu_max <= 0 || config->mtu_max > PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
             fprintf(stderr, "Invalid max mtu: %s\n", config_optval_param_string(opval_buffer, 256, params, nb_params, 0));
             ret = -1;
         }
@@ -434,6 +439,61 @@ static int config_set_option(option_table_line_t* option_desc, option_param_t* p
         }
         break;
     }
+    case picoquic_option_Packet_Pool: {
+        int v = config_atoi(params, nb_params, 0, &ret);
+        if (ret != 0 || v < 0) {
+            fprintf(stderr, "Invalid packet pool size: %s\n", config_optval_param_string(opval_buffer, 256, params, nb_params, 0));
+            ret = (ret == 0) ? -1 : ret;
+        }
+        else {
+            config->tuning.max_packets_in_pool = (size_t)v;
+        }
+        break;
+    }
+    case picoquic_option_Data_Node_Pool: {
+        int v = config_atoi(params, nb_params, 0, &ret);
+        if (ret != 0 || v < 0) {
+            fprintf(stderr, "Invalid data node pool size: %s\n", config_optval_param_string(opval_buffer, 256, params, nb_params, 0));
+            ret = (ret == 0) ? -1 : ret;
+        }
+        else {
+            config->tuning.max_data_nodes_in_pool = (size_t)v;
+        }
+        break;
+    }
+    case picoquic_option_Recv_Batch: {
+        int v = config_atoi(params, nb_params, 0, &ret);
+        if (ret != 0 || v < 0) {
+            fprintf(stderr, "Invalid receive batch: %s\n", config_optval_param_string(opval_buffer, 256, params, nb_params, 0));
+            ret = (ret == 0) ? -1 : ret;
+        }
+        else {
+            config->tuning.packet_loop_recv_max = (size_t)v;
+        }
+        break;
+    }
+    case picoquic_option_Send_Batch: {
+        int v = config_atoi(params, nb_params, 0, &ret);
+        if (ret != 0 || v < 0) {
+            fprintf(stderr, "Invalid send batch: %s\n", config_optval_param_string(opval_buffer, 256, params, nb_params, 0));
+            ret = (ret == 0) ? -1 : ret;
+        }
+        else {
+            config->tuning.packet_loop_send_max = (size_t)v;
+        }
+        break;
+    }
+    case picoquic_option_Path_Target: {
+        int v = config_atoi(params, nb_params, 0, &ret);
+        if (ret != 0 || v < 0 || v > PICOQUIC_NB_PATH_MAX) {
+            fprintf(stderr, "Invalid path target: %s\n", config_optval_param_string(opval_buffer, 256, params, nb_params, 0));
+            ret = (ret == 0) ? -1 : ret;
+        }
+        else {
+            config->tuning.max_simultaneous_paths = v;
+        }
+        break;
+    }
     case picoquic_option_AddressDiscovery: {
         int v = config_atoi(params, nb_params, 0, &ret);
         if (ret != 0 || v < 0 || v > 2) {
@@ -486,6 +546,10 @@ int picoquic_config_option_letters(char* option_string, size_t string_max, size_
     int ret = 0;
 
     for (size_t i = 0; l + 1 < string_max && i < option_table_size; i++) {
+        if (option_table[i].option_letter == 0) {
+            /* Long only option, only available as --name */
+            continue;
+        }
         option_string[l++] = option_table[i].option_letter;
         if (option_table[i].nb_params_required > 0) {
             if (l + 1 < string_max) {
@@ -510,7 +574,13 @@ void picoquic_config_usage_file(FILE* F)
     fprintf(F, "Picoquic options:\n");
     for (size_t i = 0; i < option_table_size; i++) {
         size_t spacer = strlen(option_table[i].param_sample);
-        fprintf(F, "  -%c %s", option_table[i].option_letter, option_table[i].param_sample);
+        if (option_table[i].option_letter == 0) {
+            fprintf(F, "  --%s %s", option_table[i].option_name, option_table[i].param_sample);
+            spacer += strlen(option_table[i].option_name);
+        }
+        else {
+            fprintf(F, "  -%c %s", option_table[i].option_letter, option_table[i].param_sample);
+        }
         while (spacer++ < 12) {
             putc(' ', F);
         }
@@ -571,7 +641,7 @@ int picoquic_config_get_option_char_index(int opt)
     int option_index = -1;
 
     for (size_t i = 0; i < option_table_size; i++) {
-        if (option_table[i].option_letter == opt) {
+        if (opt != 0 && option_table[i].option_letter == opt) {
             option_index = (int)i;
             break;
         }
@@ -684,6 +754,62 @@ int picoquic_config_command_line_ex(char const * opt_string, int* p_optind, int
     return ret;
 }
 
+int picoquic_config_check_option_letters(char const* app_letters)
+{
+    int ret = 0;
+
+    for (size_t i = 0; app_letters[i] != 0; i++) {
+        if (app_letters[i] != ':' && picoquic_config_get_option_char_index(app_letters[i]) >= 0) {
+            fprintf(stderr, "Option -%c is already used by the picoquic options\n", app_letters[i]);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int picoquic_config_long_options(int* p_argc, char** argv, picoquic_quic_config_t* config)
+{
+    int ret = 0;
+    int i = 1;
+
+    while (ret == 0 && i < *p_argc) {
+        if (strcmp(argv[i], "--") == 0) {
+            break;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == '-' && argv[i][2] != 0) {
+            int option_index = picoquic_config_get_command_line_option_index(argv[i]);
+
+            if (option_index == -1) {
+                fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                ret = -1;
+            }
+            else {
+                int opt_ind = i + 1;
+                char const* optarg = NULL;
+
+                if (option_table[option_index].nb_params_required > 0 && opt_ind < *p_argc) {
+                    optarg = argv[opt_ind++];
+                }
+                ret = picoquic_get_command_line_option_value(option_index, argv[i], &opt_ind,
+                    (char const**)argv, *p_argc, optarg, config);
+                if (ret == 0) {
+                    /* Remove the option and its parameters, so getopt only sees the other arguments */
+                    int nb_removed = opt_ind - i;
+                    for (int j = i; j + nb_removed < *p_argc; j++) {
+                        argv[j] = argv[j + nb_removed];
+                    }
+                    *p_argc -= nb_removed;
+                    argv[*p_argc] = NULL;
+                }
+            }
+        }
+        else {
+            i++;
+        }
+    }
+    return ret;
+}
+
 #if 0
 /* Reading parameters from a file instead of the command line.
 * Apparently never used, also not tested.
@@ -765,6 +891,143 @@ int picoquic_config_file(char const* file_name, picoquic_quic_config_t* config)
 }
 #endif
 
+/* Apply the configuration options to a context just created. The ECH
+ * configuration file is only created once, when configuring the first
+ * context of a group. */
+static int picoquic_config_apply(picoquic_quic_t* quic, picoquic_quic_config_t* config, int is_first)
+{
+    int ret = 0;
+    picoquic_congestion_algorithm_t const* cc_algo = NULL;
+
+    /* Additional configuration options */
+    /* picoquic_set_alpn_select_fn(qserver, picoquic_demo_server_callback_select_alpn); */
+    if (config->do_retry) {
+        picoquic_set_cookie_mode(quic, 1);
+    }
+    else {
+        /* TODO: option to provide cookie by default or not */
+        picoquic_set_cookie_mode(quic, 2);
+    }
+
+    if (config->cc_algo_id != NULL) {
+        cc_algo = picoquic_get_congestion_algorithm(config->cc_algo_id);
+        if (cc_algo == NULL) {
+            fprintf(stderr, "Unrecognized congestion algorithm: %s. Using BBR isntead.\n", config->cc_algo_id);
+        }
+    }
+    if (cc_algo == NULL) {
+        cc_algo = picoquic_bbr_algorithm;
+    }
+
+    picoquic_set_default_congestion_algorithm_ex(quic, cc_algo, config->cc_algo_option_string);
+
+    picoquic_set_default_spinbit_policy(quic, config->spinbit_policy);
+    picoquic_set_default_lossbit_policy(quic, config->lossbit_policy);
+
+    picoquic_set_default_multipath_option(quic, config->multipath_option);
+    picoquic_set_default_idle_timeout(quic, (uint64_t)config->idle_timeout);
+
+    picoquic_set_cwin_max(quic, config->cwin_max);
+    picoquic_set_default_address_discovery_mode(quic, config->address_discovery_mode);
+    picoquic_set_tuning(quic, &config->tuning);
+
+    if (config->token_file_name) {
+        if (picoquic_load_retry_tokens(quic, config->token_file_name) != 0) {
+            fprintf(stderr, "No token file present. Will create one as <%s>.\n", config->token_file_name);
+        }
+    }
+
+    if (config->force_zero_share) {
+        quic->client_zero_share = 1;
+    }
+
+    if (config->mtu_max > 0) {
+        picoquic_set_mtu_max(quic, config->mtu_max);
+    }
+
+    if (config->cnx_id_length != -1) {
+        if (picoquic_set_default_connection_id_length(quic, (uint8_t)config->cnx_id_length) != 0) {
+            fprintf(stderr, "Could not set CNX-ID length #%d.\n", config->cnx_id_length);
+        }
+    }
+
+    /* Cannot set the cnx_id callback here, because it requires libraries
+     * that are not linked by default */
+
+     /* TODO: parameters to define padding policy */
+    picoquic_set_padding_policy(quic, 39, 128);
+
+    picoquic_set_binlog(quic, config->bin_dir);
+
+    /* We cannot set qlog here, because of the dependency on libraries
+     * that are not linked with picoquic by default. The application
+     * will have to call:
+     *    picoquic_set_qlog(quic, config->qlog_dir);
+     */
+
+    picoquic_set_textlog(quic, config->log_file);
+
+    picoquic_set_log_level(quic, config->use_long_log);
+
+    picoquic_set_preemptive_repeat_policy(quic, config->do_preemptive_repeat);
+
+    picoquic_disable_port_blocking(quic, config->disable_port_blocking);
+
+#ifndef PICOQUIC_WITHOUT_SSLKEYLOG
+    picoquic_enable_sslkeylog(quic, config->enable_sslkeylog);
+#endif
+
+    if (config->initial_random >= 0 && config->initial_random <= 2) {
+        picoquic_set_random_initial(quic, config->initial_random);
+    }
+
+    if (config->cipher_suite_id != 0) {
+        int iana_cipher_suite_code = config->cipher_suite_id;
+        if (config->cipher_suite_id == 20) {
+            iana_cipher_suite_code = PICOQUIC_CHACHA20_POLY1305_SHA256;
+        }
+        else if (config->cipher_suite_id == 128) {
+            iana_cipher_suite_code = PICOQUIC_AES_128_GCM_SHA256;
+        }
+        else if (config->cipher_suite_id == 256) {
+            iana_cipher_suite_code = PICOQUIC_AES_256_GCM_SHA384;
+        }
+        if (picoquic_set_cipher_suite(quic, iana_cipher_suite_code) != 0) {
+            fprintf(stderr, "Could not set cipher suite #%d.\n", config->cipher_suite_id);
+        }
+    }
+
+    if (config->do_retry != 0) {
+        picoquic_set_cookie_mode(quic, 1);
+    }
+    else {
+        picoquic_set_cookie_mode(quic, 2);
+    }
+    /* TODO: control whether to */
+    /* picoquic_set_key_log_file_from_env(quic); */
+
+    picoquic_set_default_bdp_frame_option(quic, config->bdp_frame_option);
+
+    if (config->ech_public_name != NULL && is_first) {
+        if (config->ech_key_file == NULL || config->ech_config_file) {
+            fprintf(stderr, "Cannot create a configuration if key and config file are not specified.\n");
+        } else {
+            ret = picoquic_ech_create_config_file(config->ech_public_name, config->ech_key_file, config->ech_config_file);
+        }
+    }
+
+    if (ret == 0) {
+        ret = picoquic_ech_configure_quic_ctx(quic, config->ech_key_file, config->ech_config_file);
+    }
+
+    if (ret != 0) {
+        /* Something went wrong */
+        DBG_PRINTF("QUIC configuration fails, ret = %d (0x%x)", ret, ret);
+    }
+
+    return ret;
+}
+
 /* Create a QUIC Context based on configuration data.
  * Arguments from configuration:
  * - uint32_t nb_connections,
@@ -815,139 +1078,45 @@ picoquic_quic_t* picoquic_create_and_configure(picoquic_quic_config_t* config,
         config->ticket_encryption_key,
         config->ticket_encryption_key_length);
 
-    if (quic != NULL) {
-        int ret = 0;
-        picoquic_congestion_algorithm_t const* cc_algo = NULL;
-
-        /* Additional configuration options */
-        /* picoquic_set_alpn_select_fn(qserver, picoquic_demo_server_callback_select_alpn); */
-        if (config->do_retry) {
-            picoquic_set_cookie_mode(quic, 1);
-        }
-        else {
-            /* TODO: option to provide cookie by default or not */
-            picoquic_set_cookie_mode(quic, 2);
-        }
-
-        if (config->cc_algo_id != NULL) {
-            cc_algo = picoquic_get_congestion_algorithm(config->cc_algo_id);
-            if (cc_algo == NULL) {
-                fprintf(stderr, "Unrecognized congestion algorithm: %s. Using BBR isntead.\n", config->cc_algo_id);
-            }
-        }
-        if (cc_algo == NULL) {
-            cc_algo = picoquic_bbr_algorithm;
-        }
-
-        picoquic_set_default_congestion_algorithm_ex(quic, cc_algo, config->cc_algo_option_string);
-
-        picoquic_set_default_spinbit_policy(quic, config->spinbit_policy);
-        picoquic_set_default_lossbit_policy(quic, config->lossbit_policy);
-
-        picoquic_set_default_multipath_option(quic, config->multipath_option);
-        picoquic_set_default_idle_timeout(quic, (uint64_t)config->idle_timeout);
-
-        picoquic_set_cwin_max(quic, config->cwin_max);
-        picoquic_set_default_address_discovery_mode(quic, config->address_discovery_mode);
-
-        if (config->token_file_name) {
-            if (picoquic_load_retry_tokens(quic, config->token_file_name) != 0) {
-                fprintf(stderr, "No token file present. Will create one as <%s>.\n", config->token_file_name);
-            }
-        }
-
-        if (config->force_zero_share) {
-            quic->client_zero_share = 1;
-        }
-
-        if (config->mtu_max > 0) {
-            picoquic_set_mtu_max(quic, config->mtu_max);
-        }
-
-        if (config->cnx_id_length != -1) {
-            if (picoquic_set_default_connection_id_length(quic, (uint8_t)config->cnx_id_length) != 0) {
-                fprintf(stderr, "Could not set CNX-ID length #%d.\n", config->cnx_id_length);
-            }
-        }
-
-        /* Cannot set the cnx_id callback here, because it requires libraries
-         * that are not linked by default */
-
-         /* TODO: parameters to define padding policy */
-        picoquic_set_padding_policy(quic, 39, 128);
-
-        picoquic_set_binlog(quic, config->bin_dir);
-
-        /* We cannot set qlog here, because of the dependency on libraries
-         * that are not linked with picoquic by default. The application
-         * will have to call:
-         *    picoquic_set_qlog(quic, config->qlog_dir);
-         */
-
-        picoquic_set_textlog(quic, config->log_file);
-
-        picoquic_set_log_level(quic, config->use_long_log);
-
-        picoquic_set_preemptive_repeat_policy(quic, config->do_preemptive_repeat);
-
-        picoquic_disable_port_blocking(quic, config->disable_port_blocking);
-
-#ifndef PICOQUIC_WITHOUT_SSLKEYLOG
-        picoquic_enable_sslkeylog(quic, config->enable_sslkeylog);
-#endif
-
-        if (config->initial_random >= 0 && config->initial_random <= 2) {
-            picoquic_set_random_initial(quic, config->initial_random);
-        }
-
-        if (config->cipher_suite_id != 0) {
-            int iana_cipher_suite_code = config->cipher_suite_id;
-            if (config->cipher_suite_id == 20) {
-                iana_cipher_suite_code = PICOQUIC_CHACHA20_POLY1305_SHA256;
-            }
-            else if (config->cipher_suite_id == 128) {
-                iana_cipher_suite_code = PICOQUIC_AES_128_GCM_SHA256;
-            }
-            else if (config->cipher_suite_id == 256) {
-                iana_cipher_suite_code = PICOQUIC_AES_256_GCM_SHA384;
-            }
-            if (picoquic_set_cipher_suite(quic, iana_cipher_suite_code) != 0) {
-                fprintf(stderr, "Could not set cipher suite #%d.\n", config->cipher_suite_id);
-            }
-        }
-
-        if (config->do_retry != 0) {
-            picoquic_set_cookie_mode(quic, 1);
-        }
-        else {
-            picoquic_set_cookie_mode(quic, 2);
-        }
-        /* TODO: control whether to */
-        /* picoquic_set_key_log_file_from_env(quic); */
-
-        picoquic_set_default_bdp_frame_option(quic, config->bdp_frame_option);
+    if (quic != NULL && picoquic_config_apply(quic, config, 1) != 0) {
+        picoquic_free(quic);
+        quic = NULL;
+    }
 
-        if (config->ech_public_name != NULL) {
-            if (config->ech_key_file == NULL || config->ech_config_file) {
-                fprintf(stderr, "Cannot create a configuration if key and config file are not specified.\n");
-            } else {
-                ret = picoquic_ech_create_config_file(config->ech_public_name, config->ech_key_file, config->ech_config_file);
-            }
-        }
+    return quic;
+}
 
-        if (ret == 0) {
-            ret = picoquic_ech_configure_quic_ctx(quic, config->ech_key_file, config->ech_config_file);
-        }
+picoquic_quic_group_t* picoquic_create_and_configure_group(int nb_shards, picoquic_quic_config_t* config,
+    picoquic_stream_data_cb_fn default_callback_fn,
+    void* default_callback_ctx,
+    uint64_t current_time,
+    uint64_t* p_simulated_time)
+{
+    picoquic_quic_group_t* group = picoquic_create_quic_group(nb_shards,
+        config->nb_connections,
+        config->server_cert_file,
+        config->server_key_file,
+        config->root_trust_file,
+        config->alpn,
+        default_callback_fn,
+        default_callback_ctx,
+        NULL,
+        NULL,
+        (config->has_reset_seed) ? (uint8_t*)config->reset_seed : NULL,
+        current_time,
+        p_simulated_time,
+        config->ticket_file_name,
+        config->ticket_encryption_key,
+        config->ticket_encryption_key_length);
 
-        if (ret != 0) {
-            /* Something went wrong */
-            DBG_PRINTF("QUIC configuration fails, ret = %d (0x%x)", ret, ret);
-            picoquic_free(quic);
-            quic = NULL;
+    for (int i = 0; group != NULL && i < nb_shards; i++) {
+        if (picoquic_config_apply(picoquic_quic_group_shard(group, i), config, i == 0) != 0) {
+            picoquic_delete_quic_group(group);
+            group = NULL;
         }
     }
 
-    return quic;
+    return group;
 }
 
 void picoquic_config_init(picoquic_quic_config_t* config)
@@ -0,0 +1,509 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2025, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Coupled congestion control for multipath connections.
+*
+* With multipath, each path runs its own instance of the congestion control
+* algorithm. If each of them behaves like New Reno, a connection with N paths
+* through the same bottleneck gets N times the share of a single path flow,
+* and the traffic only moves slowly to the better paths. The coupled
+* algorithms keep the slow start, loss recovery and window reduction of
+* New Reno on each path, but couple the increase in congestion avoidance
+* across the paths of the connection:
+*
+* - LIA, "Linked Increases", RFC 6356. The increase on each path is capped
+*   so that the connection as a whole is no more aggressive than a single
+*   New Reno flow on its best path.
+* - OLIA, "Opportunistic Linked Increases", Khalili et al., IEEE/ACM ToN
+*   2013. The increase is proportional to the share of the path in the
+*   aggregate throughput, plus a term that moves window from the paths with
+*   the largest window to the paths with the best loss and delay profile.
+* - BALIA, "Balanced Linked Adaptation", Peng et al., IEEE/ACM ToN 2016
+*   and draft-walid-mptcp-congestion-control. Balances the responsiveness
+*   of LIA with the friendliness of OLIA; the decrease on loss also depends
+*   on the relative throughput of the path.
+*
+* The aggregate state of the connection (sum of the windows, of the rates,
+* best path) is computed from the paths that use the same algorithm each time
+* it is needed: connections only have a few paths, and this avoids keeping a
+* connection level copy that could get out of sync when paths are created or
+* abandoned. Paths that are demoted or have no RTT measurement yet are not
+* part of the aggregate. With a single path, the three algorithms behave
+* exactly like New Reno.
+*/
+
+#include "picoquic_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include "cc_common.h"
+#include "picoquic_coupled_cc.h"
+
+typedef enum {
+    picoquic_coupled_lia = 0,
+    picoquic_coupled_olia,
+    picoquic_coupled_balia
+} picoquic_coupled_variant_t;
+
+typedef struct st_picoquic_coupled_state_t {
+    picoquic_coupled_variant_t variant;
+    picoquic_newreno_sim_state_t nrss;
+    picoquic_min_max_rtt_t rtt_filter;
+    double residual; /* Fraction of byte not yet added to the window */
+    uint64_t loss_delivered; /* Value of path_x->delivered at the last loss */
+    uint64_t loss_interval; /* Bytes delivered between the last two losses */
+} picoquic_coupled_state_t;
+
+/* Aggregate values over the coupled paths of the connection.
+ * Windows are in bytes, RTT in microseconds, rates in bytes per microsecond.
+ */
+typedef struct st_picoquic_coupled_aggregate_t {
+    int nb_paths;
+    double cwin_total;
+    double rate_total;
+    double rate_max;
+    double cwin_max;
+    double cwin_rtt2_max;
+    double loss_rtt_max;
+    int nb_cwin_max;
+    int nb_collected;
+    int is_collected;
+} picoquic_coupled_aggregate_t;
+
+static double picoquic_coupled_rtt(picoquic_path_t* path_x)
+{
+    return (path_x->smoothed_rtt > 0) ? (double)path_x->smoothed_rtt : 1.0;
+}
+
+/* All the paths of a connection use the same algorithm, so the state of
+ * every path is a coupled state. */
+static int picoquic_coupled_is_member(picoquic_path_t* path_x)
+{
+    return (path_x->congestion_alg_state != NULL && path_x->rtt_is_initialized &&
+        !path_x->path_is_demoted);
+}
+
+/* OLIA ranks paths by l^2/rtt, where l is the largest of the number of bytes
+ * delivered between the last two losses and since the last loss. */
+static double picoquic_coupled_loss_rtt(picoquic_path_t* path_x)
+{
+    picoquic_coupled_state_t* c_state = (picoquic_coupled_state_t*)path_x->congestion_alg_state;
+    double l = (double)(path_x->delivered - c_state->loss_delivered);
+
+    if ((double)c_state->loss_interval > l) {
+        l = (double)c_state->loss_interval;
+    }
+
+    return (l * l) / picoquic_coupled_rtt(path_x);
+}
+
+static void picoquic_coupled_aggregate(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_coupled_aggregate_t* agg)
+{
+    memset(agg, 0, sizeof(picoquic_coupled_aggregate_t));
+
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        picoquic_path_t* path_i = cnx->path[i];
+
+        if (picoquic_coupled_is_member(path_i)) {
+            double cwin = (double)path_i->cwin;
+            double rtt = picoquic_coupled_rtt(path_i);
+            double rate = cwin / rtt;
+            double loss_rtt = picoquic_coupled_loss_rtt(path_i);
+
+            agg->nb_paths++;
+            agg->cwin_total += cwin;
+            agg->rate_total += rate;
+            if (rate > agg->rate_max) {
+                agg->rate_max = rate;
+            }
+            if (cwin / (rtt * rtt) > agg->cwin_rtt2_max) {
+                agg->cwin_rtt2_max = cwin / (rtt * rtt);
+            }
+            if (cwin > agg->cwin_max) {
+                agg->cwin_max = cwin;
+                agg->nb_cwin_max = 1;
+            }
+            else if (cwin == agg->cwin_max) {
+                agg->nb_cwin_max++;
+            }
+            if (loss_rtt > agg->loss_rtt_max) {
+                agg->loss_rtt_max = loss_rtt;
+            }
+        }
+    }
+
+    /* OLIA: the "collected" paths are the best paths that do not have the largest window */
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        picoquic_path_t* path_i = cnx->path[i];
+
+        if (picoquic_coupled_is_member(path_i) && (double)path_i->cwin < agg->cwin_max &&
+            picoquic_coupled_loss_rtt(path_i) >= agg->loss_rtt_max) {
+            agg->nb_collected++;
+            if (path_i == path_x) {
+                agg->is_collected = 1;
+            }
+        }
+    }
+}
+
+/* Window increase in congestion avoidance, for nb_bytes acknowledged on path_x.
+ * The result may be negative for OLIA, when the window moves to a better path.
+ */
+static int64_t picoquic_coupled_increase(picoquic_coupled_state_t* c_state, picoquic_cnx_t* cnx,
+    picoquic_path_t* path_x, uint64_t nb_bytes)
+{
+    picoquic_coupled_aggregate_t agg;
+    double mss = (double)path_x->send_mtu;
+    double bytes = (double)nb_bytes;
+    double cwin = (double)path_x->cwin;
+    double rtt = picoquic_coupled_rtt(path_x);
+    double reno_increase = bytes * mss / cwin;
+    double increase = reno_increase;
+    int64_t applied;
+
+    picoquic_coupled_aggregate(cnx, path_x, &agg);
+
+    if (agg.nb_paths > 1 && agg.rate_total > 0) {
+        switch (c_state->variant) {
+        case picoquic_coupled_lia: {
+            double alpha = agg.cwin_total * agg.cwin_rtt2_max / (agg.rate_total * agg.rate_total);
+            double coupled = alpha * bytes * mss / agg.cwin_total;
+
+            increase = (coupled < reno_increase) ? coupled : reno_increase;
+            break;
+        }
+        case picoquic_coupled_olia: {
+            double alpha = 0;
+
+            if (agg.nb_collected > 0) {
+                if (agg.is_collected) {
+                    alpha = 1.0 / ((double)agg.nb_paths * (double)agg.nb_collected);
+                }
+                else if (cwin >= agg.cwin_max) {
+                    alpha = -1.0 / ((double)agg.nb_paths * (double)agg.nb_cwin_max);
+                }
+            }
+            increase = bytes * ((mss * cwin / (rtt * rtt)) / (agg.rate_total * agg.rate_total) + alpha * mss / cwin);
+            break;
+        }
+        case picoquic_coupled_balia: {
+            double rate = cwin / rtt;
+            double alpha = agg.rate_max / rate;
+
+            increase = bytes * mss * rate / (rtt * agg.rate_total * agg.rate_total) *
+                ((1.0 + alpha) / 2.0) * ((4.0 + alpha) / 5.0);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    c_state->residual += increase;
+    applied = (int64_t)c_state->residual;
+    c_state->residual -= (double)applied;
+
+    return applied;
+}
+
+/* BALIA reduces the window of the slower paths less than the window of the faster paths */
+static void picoquic_coupled_balia_decrease(picoquic_coupled_state_t* c_state, picoquic_cnx_t* cnx,
+    picoquic_path_t* path_x, uint64_t cwin_before)
+{
+    picoquic_coupled_aggregate_t agg;
+
+    picoquic_coupled_aggregate(cnx, path_x, &agg);
+
+    if (agg.nb_paths > 1 && path_x->cwin > 0) {
+        double rate = (double)cwin_before / picoquic_coupled_rtt(path_x);
+        double alpha = (rate > 0) ? agg.rate_max / rate : 1.0;
+        uint64_t cwin;
+
+        if (alpha > 1.5) {
+            alpha = 1.5;
+        }
+        cwin = (uint64_t)((double)cwin_before * (1.0 - alpha / 2.0));
+        if (cwin < PICOQUIC_CWIN_MINIMUM) {
+            cwin = PICOQUIC_CWIN_MINIMUM;
+        }
+        c_state->nrss.cwin = cwin;
+        c_state->nrss.ssthresh = cwin;
+    }
+}
+
+static void picoquic_coupled_reset(picoquic_coupled_state_t* c_state, picoquic_path_t* path_x)
+{
+    picoquic_coupled_variant_t variant = c_state->variant;
+
+    memset(c_state, 0, sizeof(picoquic_coupled_state_t));
+    c_state->variant = variant;
+    picoquic_newreno_sim_reset(&c_state->nrss);
+    c_state->loss_delivered = path_x->delivered;
+    path_x->cwin = c_state->nrss.cwin;
+}
+
+static void picoquic_coupled_init(picoquic_path_t* path_x, picoquic_coupled_variant_t variant)
+{
+    picoquic_coupled_state_t* c_state = (picoquic_coupled_state_t*)malloc(sizeof(picoquic_coupled_state_t));
+
+    if (c_state != NULL) {
+        c_state->variant = variant;
+        picoquic_coupled_reset(c_state, path_x);
+    }
+    path_x->congestion_alg_state = c_state;
+}
+
+static void picoquic_lia_init(picoquic_cnx_t* cnx, picoquic_path_t* path_x, char const* option_string, uint64_t current_time)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(option_string);
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+    picoquic_coupled_init(path_x, picoquic_coupled_lia);
+}
+
+static void picoquic_olia_init(picoquic_cnx_t* cnx, picoquic_path_t* path_x, char const* option_string, uint64_t current_time)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(option_string);
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+    picoquic_coupled_init(path_x, picoquic_coupled_olia);
+}
+
+static void picoquic_balia_init(picoquic_cnx_t* cnx, picoquic_path_t* path_x, char const* option_string, uint64_t current_time)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(option_string);
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+    picoquic_coupled_init(path_x, picoquic_coupled_balia);
+}
+
+/* The notifications are handled as in New Reno, except for the increase
+ * in congestion avoidance and for the loss intervals and BALIA decrease
+ * when a recovery starts. */
+static void picoquic_coupled_notify(
+    picoquic_cnx_t* cnx,
+    picoquic_path_t* path_x,
+    picoquic_congestion_notification_t notification,
+    picoquic_per_ack_state_t* ack_state,
+    uint64_t current_time)
+{
+    picoquic_coupled_state_t* c_state = (picoquic_coupled_state_t*)path_x->congestion_alg_state;
+
+    path_x->is_cc_data_updated = 1;
+
+    if (c_state != NULL) {
+        switch (notification) {
+        case picoquic_congestion_notification_acknowledgement:
+            if (c_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
+                c_state->nrss.ssthresh == UINT64_MAX) {
+                /* Increase cwin based on bandwidth estimation. */
+                path_x->cwin = picoquic_cc_update_target_cwin_estimation(path_x);
+                c_state->nrss.cwin = path_x->cwin;
+            }
+
+            if (path_x->last_time_acked_data_frame_sent > path_x->last_sender_limited_time) {
+                if (c_state->nrss.alg_state == picoquic_newreno_alg_congestion_avoidance) {
+                    int64_t increase = picoquic_coupled_increase(c_state, cnx, path_x, ack_state->nb_bytes_acknowledged);
+
+                    if (increase < 0 && c_state->nrss.cwin < PICOQUIC_CWIN_MINIMUM + (uint64_t)(-increase)) {
+                        c_state->nrss.cwin = PICOQUIC_CWIN_MINIMUM;
+                    }
+                    else {
+                        c_state->nrss.cwin = (uint64_t)((int64_t)c_state->nrss.cwin + increase);
+                    }
+                }
+                else {
+                    picoquic_newreno_sim_notify(&c_state->nrss, cnx, path_x, notification, ack_state, current_time);
+                }
+                path_x->cwin = c_state->nrss.cwin;
+            }
+            break;
+        case picoquic_congestion_notification_seed_cwin:
+            picoquic_newreno_sim_notify(&c_state->nrss, cnx, path_x, notification, ack_state, current_time);
+            path_x->cwin = c_state->nrss.cwin;
+            break;
+        case picoquic_congestion_notification_ecn_ec:
+        case picoquic_congestion_notification_repeat:
+        case picoquic_congestion_notification_timeout: {
+            uint64_t cwin_before = c_state->nrss.cwin;
+            uint64_t recovery_sequence = c_state->nrss.recovery_sequence;
+            uint64_t recovery_start = c_state->nrss.recovery_start;
+
+            picoquic_newreno_sim_notify(&c_state->nrss, cnx, path_x, notification, ack_state, current_time);
+            if (c_state->nrss.recovery_sequence != recovery_sequence || c_state->nrss.recovery_start != recovery_start) {
+                /* A new recovery period started */
+                c_state->loss_interval = path_x->delivered - c_state->loss_delivered;
+                c_state->loss_delivered = path_x->delivered;
+                c_state->residual = 0;
+                if (c_state->variant == picoquic_coupled_balia &&
+                    notification != picoquic_congestion_notification_timeout) {
+                    picoquic_coupled_balia_decrease(c_state, cnx, path_x, cwin_before);
+                }
+            }
+            path_x->cwin = c_state->nrss.cwin;
+            break;
+        }
+        case picoquic_congestion_notification_spurious_repeat:
+            picoquic_newreno_sim_notify(&c_state->nrss, cnx, path_x, notification, ack_state, current_time);
+            path_x->cwin = c_state->nrss.cwin;
+            path_x->is_ssthresh_initialized = 1;
+            break;
+        case picoquic_congestion_notification_rtt_measurement:
+            if (c_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
+                c_state->nrss.ssthresh == UINT64_MAX) {
+                /* if in slow start, increase the window for long delay RTT */
+                if (path_x->rtt_min > PICOQUIC_TARGET_RENO_RTT) {
+                    path_x->cwin = picoquic_cc_update_cwin_for_long_rtt(path_x);
+                    c_state->nrss.cwin = path_x->cwin;
+                }
+
+                /* HyStart, using RTT increases as signal to get out of initial slow start */
+                if (picoquic_cc_hystart_test(&c_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
+                    cnx->path[0]->pacing.packet_time_microsec, current_time, cnx->is_time_stamp_enabled)) {
+                    c_state->nrss.ssthresh = c_state->nrss.cwin;
+                    c_state->nrss.alg_state = picoquic_newreno_alg_congestion_avoidance;
+                    path_x->cwin = c_state->nrss.cwin;
+                    path_x->is_ssthresh_initialized = 1;
+                }
+            }
+            break;
+        case picoquic_congestion_notification_reset:
+            picoquic_coupled_reset(c_state, path_x);
+            break;
+        default:
+            /* ignore */
+            break;
+        }
+
+        /* Compute pacing data */
+        picoquic_update_pacing_data(cnx, path_x, c_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
+            c_state->nrss.ssthresh == UINT64_MAX);
+    }
+}
+
+static void picoquic_coupled_delete(picoquic_path_t* path_x)
+{
+    if (path_x->congestion_alg_state != NULL) {
+        free(path_x->congestion_alg_state);
+        path_x->congestion_alg_state = NULL;
+    }
+}
+
+static void picoquic_coupled_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint64_t* cc_param)
+{
+    picoquic_coupled_state_t* c_state = (picoquic_coupled_state_t*)path_x->congestion_alg_state;
+    *cc_state = (uint64_t)c_state->nrss.alg_state;
+    *cc_param = (c_state->nrss.ssthresh == UINT64_MAX) ? 0 : c_state->nrss.ssthresh;
+}
+
+/* The snapshot contains the algorithm state, the slow start threshold
+ * and the last loss interval. The variant is implied by the algorithm. */
+static uint8_t* picoquic_coupled_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_coupled_state_t* c_state = (picoquic_coupled_state_t*)path_x->congestion_alg_state;
+    uint64_t values[3];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    values[0] = (uint64_t)c_state->nrss.alg_state;
+    values[1] = c_state->nrss.ssthresh;
+    values[2] = c_state->loss_interval;
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 3);
+}
+
+static const uint8_t* picoquic_coupled_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_coupled_state_t* c_state = (picoquic_coupled_state_t*)path_x->congestion_alg_state;
+    uint64_t values[3];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 3)) != NULL) {
+        if (values[0] > picoquic_newreno_alg_congestion_avoidance) {
+            bytes = NULL;
+        }
+        else {
+            c_state->nrss.alg_state = (picoquic_newreno_alg_state_t)values[0];
+            c_state->nrss.ssthresh = values[1];
+            c_state->nrss.residual_ack = 0;
+            c_state->nrss.cwin = path_x->cwin;
+            c_state->nrss.recovery_start = 0;
+            c_state->nrss.recovery_sequence = picoquic_cc_get_sequence_number(cnx, path_x);
+            c_state->loss_interval = values[2];
+            c_state->loss_delivered = path_x->delivered;
+            c_state->residual = 0;
+            picoquic_update_pacing_data(cnx, path_x, c_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
+                c_state->nrss.ssthresh == UINT64_MAX);
+        }
+    }
+
+    return bytes;
+}
+
+/* Definition records of the coupled algorithms */
+
+#define PICOQUIC_LIA_ID "lia"
+#define PICOQUIC_OLIA_ID "olia"
+#define PICOQUIC_BALIA_ID "balia"
+
+picoquic_congestion_algorithm_t picoquic_lia_algorithm_struct = {
+    PICOQUIC_LIA_ID, PICOQUIC_CC_ALGO_NUMBER_LIA,
+    picoquic_lia_init,
+    picoquic_coupled_notify,
+    picoquic_coupled_delete,
+    picoquic_coupled_observe,
+    picoquic_coupled_export,
+    picoquic_coupled_import
+};
+
+picoquic_congestion_algorithm_t picoquic_olia_algorithm_struct = {
+    PICOQUIC_OLIA_ID, PICOQUIC_CC_ALGO_NUMBER_OLIA,
+    picoquic_olia_init,
+    picoquic_coupled_notify,
+    picoquic_coupled_delete,
+    picoquic_coupled_observe,
+    picoquic_coupled_export,
+    picoquic_coupled_import
+};
+
+picoquic_congestion_algorithm_t picoquic_balia_algorithm_struct = {
+    PICOQUIC_BALIA_ID, PICOQUIC_CC_ALGO_NUMBER_BALIA,
+    picoquic_balia_init,
+    picoquic_coupled_notify,
+    picoquic_coupled_delete,
+    picoquic_coupled_observe,
+    picoquic_coupled_export,
+    picoquic_coupled_import
+};
+
+picoquic_congestion_algorithm_t* picoquic_lia_algorithm = &picoquic_lia_algorithm_struct;
+picoquic_congestion_algorithm_t* picoquic_olia_algorithm = &picoquic_olia_algorithm_struct;
+picoquic_congestion_algorithm_t* picoquic_balia_algorithm = &picoquic_balia_algorithm_struct;
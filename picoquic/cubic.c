@@ -48,6 +48,7 @@ typedef struct st_picoquic_cubic_state_t {
     double W_reno;
     uint64_t ssthresh;
     picoquic_min_max_rtt_t rtt_filter;
+    picoquic_hystart_pp_t hspp;
 } picoquic_cubic_state_t;
 
 static void cubic_reset(picoquic_cubic_state_t* cubic_state, picoquic_path_t* path_x, uint64_t current_time) {
@@ -65,6 +66,7 @@ static void cubic_reset(picoquic_cubic_state_t* cubic_state, picoquic_path_t* pa
     cubic_state->previous_ssthresh = UINT64_MAX;
     cubic_state->W_reno = PICOQUIC_CWIN_INITIAL;
     cubic_state->recovery_sequence = 0;
+    picoquic_hystart_pp_reset(&cubic_state->hspp, path_x->cnx, path_x);
 }
 
 static void cubic_init(picoquic_cnx_t * cnx, picoquic_path_t* path_x, char const* option_string, uint64_t current_time)
@@ -81,42 +83,25 @@ static void cubic_init(picoquic_cnx_t * cnx, picoquic_path_t* path_x, char const
     }
 }
 
+/* Compute the cube root of x with the integer cube root. The argument is
+ * scaled by 2^48 so that the root comes out in Q16, which is more than
+ * enough for K. Large windows use a smaller scale to avoid overflowing
+ * 64 bits, losing one bit of precision per step.
+ */
 static double cubic_root(double x)
 {
-    /* First find an approximation */
-    double v = 1;
-    double y = 1.0;
-    double y2;
-    double y3;
-
-    /*
-     * v = 1
-     *
-     * x = (cubic_state->W_max * (1.0 - PICOQUIC_CUBIC_BETA)) / PICOQUIC_CUBIC_C
-     * PICOQUIC_CUBIC_C = 0.4
-     * (1.0 - PICOQUIC_CUBIC_BETA) = 1 - 7/8 = 1/8
-     *
-     * v > x * 8
-     * 1 > (cubic_state->W_max * (1/8) / 0.4) * 8
-     * cubic_state->W_max < 2/5
-     */
-    while (v > x * 8) {
-        v /= 8;
-        y /= 2;
-    }
+    int shift = 48;
+    uint64_t x_scaled;
 
-    while (v < x) {
-        v *= 8;
-        y *= 2;
+    if (x <= 0) {
+        return 0;
     }
-
-    for (int i = 0; i < 3; i++) {
-        y2 = y * y;
-        y3 = y2 * y;
-        y += (x - y3) / (3.0*y2);
+    while (shift > 0 && x >= (double)(1ull << (63 - shift))) {
+        shift -= 3;
     }
+    x_scaled = (x >= 9223372036854775808.0) ? UINT64_MAX : (uint64_t)(x * (double)(1ull << shift));
 
-    return y;
+    return (double)picoquic_cc_cube_root(x_scaled) / (double)(1ull << (shift / 3));
 }
 
 /* Compute W_cubic(t) = C * (t - K) ^ 3 + W_max */
@@ -251,6 +236,9 @@ static void cubic_notify(
     path_x->is_cc_data_updated = 1;
 
     if (cubic_state != NULL) {
+        int is_initial_slow_start = (cubic_state->alg_state == picoquic_cubic_alg_slow_start &&
+            cubic_state->ssthresh == UINT64_MAX);
+
         switch (notification) {
             /* RTT measurements will happen before acknowledgement is signalled */
             case picoquic_congestion_notification_acknowledgement:
@@ -261,7 +249,7 @@ static void cubic_notify(
 
                         if (path_x->last_time_acked_data_frame_sent > path_x->last_sender_limited_time) {
                             //if (path_x->bytes_in_transit > path_x->cwin) {
-                                path_x->cwin += picoquic_cc_slow_start_increase_ex(path_x, ack_state->nb_bytes_acknowledged, 0);
+                                path_x->cwin += picoquic_hystart_pp_increase(&cubic_state->hspp, path_x, ack_state->nb_bytes_acknowledged);
 
                                 /* if cnx->cwin exceeds SSTHRESH, exit and go to CA */
                                 if (path_x->cwin >= cubic_state->ssthresh) {
@@ -348,9 +336,21 @@ static void cubic_notify(
                 if (cubic_state->alg_state == picoquic_cubic_alg_slow_start &&
                     cubic_state->ssthresh == UINT64_MAX) {
 
+                    if (cubic_state->hspp.is_enabled) {
+                        /* HyStart++. The increase was confirmed during the CSS rounds,
+                         * so the window is kept and becomes the new threshold. */
+                        if (picoquic_hystart_pp_test(&cubic_state->hspp, cnx, path_x, ack_state->rtt_measurement)) {
+                            cubic_state->ssthresh = path_x->cwin;
+                            cubic_state->W_max = (double)path_x->cwin / (double)path_x->send_mtu;
+                            cubic_state->W_last_max = cubic_state->W_max;
+                            cubic_state->W_reno = ((double)path_x->cwin);
+                            path_x->is_ssthresh_initialized = 1;
+                            cubic_enter_avoidance(cubic_state, current_time);
+                        }
+                    }
                     /* HyStart. */
                     /* Using RTT increases as signal to get out of initial slow start */
-                    if (picoquic_cc_hystart_test(&cubic_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
+                    else if (picoquic_cc_hystart_test(&cubic_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
                             cnx->path[0]->pacing.packet_time_microsec, current_time, cnx->is_time_stamp_enabled)) {
                         /* RTT increased too much, get out of slow start! */
 
@@ -417,6 +417,10 @@ static void cubic_notify(
 
         }
 
+        if (is_initial_slow_start && cubic_state->ssthresh != UINT64_MAX) {
+            picoquic_cc_record_slow_start_exit(path_x, &cubic_state->hspp, notification, current_time);
+        }
+
         /* Compute pacing data */
         picoquic_update_pacing_data(cnx, path_x, cubic_state->alg_state == picoquic_cubic_alg_slow_start &&
             cubic_state->ssthresh == UINT64_MAX);
@@ -568,6 +572,70 @@ void cubic_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint64_t* cc_par
 }
 
 
+/* Export and import the state of congestion control.
+ * The cubic windows are exported in bytes, so that they can be converted
+ * if the MTU of the new path differs. The start of the epoch is exported
+ * as an age, and K in microseconds.
+ */
+static uint64_t cubic_window_to_bytes(double W, double mtu)
+{
+    double w_bytes = W * mtu;
+    return (w_bytes >= (double)PICOQUIC_CC_SNAPSHOT_VARINT_MAX) ? UINT64_MAX : (uint64_t)w_bytes;
+}
+
+static double cubic_window_from_bytes(uint64_t w_bytes, double mtu)
+{
+    return (w_bytes == UINT64_MAX) ? ((double)UINT64_MAX) / mtu : ((double)w_bytes) / mtu;
+}
+
+static uint8_t* cubic_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_cubic_state_t* cubic_state = (picoquic_cubic_state_t*)path_x->congestion_alg_state;
+    double mtu = (double)path_x->send_mtu;
+    uint64_t values[7];
+
+    values[0] = (uint64_t)cubic_state->alg_state;
+    values[1] = cubic_state->ssthresh;
+    values[2] = cubic_window_to_bytes(cubic_state->W_max, mtu);
+    values[3] = cubic_window_to_bytes(cubic_state->W_last_max, mtu);
+    values[4] = cubic_window_to_bytes(cubic_state->W_reno, 1.0);
+    values[5] = picoquic_cc_snapshot_age(cubic_state->start_of_epoch, current_time);
+    values[6] = (uint64_t)(cubic_state->K * 1000000.0);
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 7);
+}
+
+static const uint8_t* cubic_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_cubic_state_t* cubic_state = (picoquic_cubic_state_t*)path_x->congestion_alg_state;
+    double mtu = (double)path_x->send_mtu;
+    uint64_t values[7];
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 7)) != NULL) {
+        if (values[0] > picoquic_cubic_alg_congestion_avoidance) {
+            bytes = NULL;
+        }
+        else {
+            cubic_state->alg_state = (picoquic_cubic_alg_state_t)values[0];
+            cubic_state->ssthresh = values[1];
+            cubic_state->W_max = cubic_window_from_bytes(values[2], mtu);
+            cubic_state->W_last_max = cubic_window_from_bytes(values[3], mtu);
+            cubic_state->W_reno = cubic_window_from_bytes(values[4], 1.0);
+            cubic_state->start_of_epoch = picoquic_cc_snapshot_stamp(values[5], current_time);
+            cubic_state->K = ((double)values[6]) / 1000000.0;
+            cubic_state->previous_start_of_epoch = cubic_state->start_of_epoch;
+            cubic_state->previous_alg_state = cubic_state->alg_state;
+            cubic_state->previous_ssthresh = cubic_state->ssthresh;
+            cubic_state->previous_cwin = path_x->cwin;
+            cubic_state->recovery_sequence = picoquic_cc_get_sequence_number(cnx, path_x);
+            picoquic_update_pacing_data(cnx, path_x,
+                cubic_state->alg_state == picoquic_cubic_alg_slow_start && cubic_state->ssthresh == UINT64_MAX);
+        }
+    }
+
+    return bytes;
+}
+
 /* Definition record for the Cubic algorithm */
 
 #define picoquic_cubic_ID "cubic" /* CBIC */
@@ -578,7 +646,9 @@ picoquic_congestion_algorithm_t picoquic_cubic_algorithm_struct = {
     cubic_init,
     cubic_notify,
     cubic_delete,
-    cubic_observe
+    cubic_observe,
+    cubic_export,
+    cubic_import
 };
 
 picoquic_congestion_algorithm_t picoquic_dcubic_algorithm_struct = {
@@ -586,7 +656,9 @@ picoquic_congestion_algorithm_t picoquic_dcubic_algorithm_struct = {
     cubic_init,
     dcubic_notify,
     cubic_delete,
-    cubic_observe
+    cubic_observe,
+    cubic_export,
+    cubic_import
 };
 
 picoquic_congestion_algorithm_t* picoquic_cubic_algorithm = &picoquic_cubic_algorithm_struct;
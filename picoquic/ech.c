@@ -42,6 +42,10 @@
 typedef const struct st_ptls_cipher_suite_t ptls_cipher_suite_t;
 #include "picoquic_crypto_provider_api.h"
 
+#ifndef PTLS_ECH_CONFIG_VERSION
+#define PTLS_ECH_CONFIG_VERSION 0xfe0d
+#endif
+
 /* Decode a base64 string. This is not strictly ECH related, 
 * but applications cannot easily access the base64 implementation in
 * picotls.
@@ -223,26 +227,82 @@ typedef struct st_ech_opener_callback_t {
     ptls_hpke_kem_t* kem;
     ptls_key_exchange_context_t* keyex;
     ptls_buffer_t config;
+    uint8_t config_id;
+    ptls_hpke_cipher_suite_t* ciphers[PICOQUIC_HPKE_CIPHER_SUITE_NB_MAX + 1];
+    ptls_buffer_t info;
+    size_t info_prefix_len;
 } ech_opener_callback_t;
 
+/* Parse an ECH configuration, starting at the version field. Returns the
+ * length of the configuration, or 0 if it is malformed or not the supported
+ * version. The KEM and ciphers are set if locally supported, to NULL
+ * otherwise; the list of ciphers is terminated by a NULL pointer.
+ */
+static size_t ech_parse_config(const uint8_t* bytes, size_t bytes_max, uint8_t* config_id,
+    ptls_hpke_kem_t** kem, ptls_hpke_cipher_suite_t** ciphers, size_t nb_ciphers_max)
+{
+    size_t config_len = 0;
+    size_t nb_ciphers = 0;
+
+    *kem = NULL;
+    if (bytes_max >= 9 && PICOPARSE_16(bytes) == PTLS_ECH_CONFIG_VERSION &&
+        (config_len = 4 + (size_t)PICOPARSE_16(bytes + 2)) <= bytes_max) {
+        uint16_t kem_id = PICOPARSE_16(bytes + 5);
+        size_t pk_end = 9 + (size_t)PICOPARSE_16(bytes + 7);
+        size_t cs_end;
+
+        *config_id = bytes[4];
+        for (int i = 0; i < PICOQUIC_HPKE_KEM_NB_MAX && picoquic_hpke_kems[i] != NULL; i++) {
+            if (picoquic_hpke_kems[i]->id == kem_id) {
+                *kem = picoquic_hpke_kems[i];
+                break;
+            }
+        }
+        if (pk_end + 2 > config_len ||
+            (cs_end = pk_end + 2 + (size_t)PICOPARSE_16(bytes + pk_end)) > config_len) {
+            config_len = 0;
+        }
+        else {
+            for (size_t x = pk_end + 2; x + 4 <= cs_end; x += 4) {
+                for (size_t i = 0; picoquic_hpke_cipher_suites[i] != NULL && nb_ciphers < nb_ciphers_max; ++i) {
+                    if (picoquic_hpke_cipher_suites[i]->id.kdf == PICOPARSE_16(bytes + x) &&
+                        picoquic_hpke_cipher_suites[i]->id.aead == PICOPARSE_16(bytes + x + 2)) {
+                        ciphers[nb_ciphers++] = picoquic_hpke_cipher_suites[i];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    ciphers[nb_ciphers] = NULL;
+
+    return config_len;
+}
 
 /* Find the config based on the config ID */
 /* Perform the key exchange using the public key provided by the client
- * in the "enc" parameter and the private key corresponding to the config ID */
+ * in the "enc" parameter and the private key corresponding to the config ID.
+ * The config ID and the cipher suites are checked before the key exchange,
+ * so that mismatched or grease extensions do not cost a DH computation.
+ * The key exchange context of the configuration is loaded once, and the
+ * HPKE info string is composed at the first call and then reused.
+ */
 ptls_aead_context_t* ech_opener_callback(ptls_ech_create_opener_t * cb,
     ptls_hpke_kem_t** p_kem, ptls_hpke_cipher_suite_t** cipher, ptls_t* tls, 
     uint8_t config_id, ptls_hpke_cipher_suite_id_t cipher_id, ptls_iovec_t enc, ptls_iovec_t info_prefix)
 {
     ptls_aead_context_t* aead = NULL;
-    ptls_buffer_t infobuf;
     int ret = 0;
     ech_opener_callback_t* ech_cb = (ech_opener_callback_t*)cb;
 
     *cipher = NULL;
-    for (size_t i = 0; picoquic_hpke_cipher_suites[i] != NULL; ++i) {
-        if (picoquic_hpke_cipher_suites[i]->id.kdf == cipher_id.kdf &&
-            picoquic_hpke_cipher_suites[i]->id.aead == cipher_id.aead) {
-            *cipher = picoquic_hpke_cipher_suites[i];
+    if (config_id != ech_cb->config_id) {
+        return NULL;
+    }
+    for (size_t i = 0; ech_cb->ciphers[i] != NULL; ++i) {
+        if (ech_cb->ciphers[i]->id.kdf == cipher_id.kdf &&
+            ech_cb->ciphers[i]->id.aead == cipher_id.aead) {
+            *cipher = ech_cb->ciphers[i];
             break;
         }
     }
@@ -254,14 +314,19 @@ ptls_aead_context_t* ech_opener_callback(ptls_ech_create_opener_t * cb,
     * In the unit test example, the binary string is preceded by a two bytes of length, with
     * an added null byte at the end.
     */
-
-    ptls_buffer_init(&infobuf, "", 0);
-    ptls_buffer_pushv(&infobuf, info_prefix.base, info_prefix.len);
-    ptls_buffer_pushv(&infobuf, ech_cb->config.base+2, ech_cb->config.off - 2);
+    if (ech_cb->info.off == 0 || ech_cb->info_prefix_len != info_prefix.len ||
+        memcmp(ech_cb->info.base, info_prefix.base, info_prefix.len) != 0) {
+        ech_cb->info.off = 0;
+        ech_cb->info_prefix_len = info_prefix.len;
+        ptls_buffer_pushv(&ech_cb->info, info_prefix.base, info_prefix.len);
+        ptls_buffer_pushv(&ech_cb->info, ech_cb->config.base + 2, ech_cb->config.off - 2);
+    }
     ret = ptls_hpke_setup_base_r(ech_cb->kem, *cipher, ech_cb->keyex, &aead, enc,
-        ptls_iovec_init(infobuf.base, infobuf.off));
+        ptls_iovec_init(ech_cb->info.base, ech_cb->info.off));
 Exit:
-    ptls_buffer_dispose(&infobuf);
+    if (ret != 0) {
+        ech_cb->info.off = 0;
+    }
     return aead;
 }
 
@@ -272,6 +337,7 @@ static void ech_dispose_opener_callback(ech_opener_callback_t* ech_cb)
         picoquic_keyex_dispose_fn(ech_cb->keyex);
     }
     ptls_buffer_dispose(&ech_cb->config);
+    ptls_buffer_dispose(&ech_cb->info);
     memset(ech_cb, 0, sizeof(ech_opener_callback_t));
     free(ech_cb);
 }
@@ -291,22 +357,20 @@ static int ech_init_opener_callback(ech_opener_callback_t** p_ech_cb, char const
         /* set the callback */
         ech_cb->super.cb = ech_opener_callback;
         ptls_buffer_init(&ech_cb->config, "", 0);
+        ptls_buffer_init(&ech_cb->info, "", 0);
         /* Read the config bytes into the ech_cb->config buffer */
         ret = picoquic_ech_read_config(&ech_cb->config, config_file_name);
         if (ret != 0) {
             DBG_PRINTF("Cannot read ech configuration from %s", config_file_name);
         } else {
-            uint16_t kem_id;
-            /* Get kem-id from config, then get kem from kem_id */
-            kem_id = (((uint16_t)ech_cb->config.base[7]) << 8) + ech_cb->config.base[8];
-            for (int i = 0; i < 4 && picoquic_hpke_kems[i] !=  NULL; i++) {
-                if (picoquic_hpke_kems[i]->id == kem_id) {
-                    ech_cb->kem = picoquic_hpke_kems[i];
-                    break;
-                }
+            /* Parse the config once, to get the config ID, the kem and the ciphers */
+            if (ech_cb->config.off < 2 || ech_parse_config(ech_cb->config.base + 2, ech_cb->config.off - 2,
+                &ech_cb->config_id, &ech_cb->kem, ech_cb->ciphers, PICOQUIC_HPKE_CIPHER_SUITE_NB_MAX) == 0) {
+                DBG_PRINTF("Cannot parse ech configuration from %s", config_file_name);
+                ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
             }
-            if (ech_cb->kem == NULL){
-                DBG_PRINTF("Cannot find hpke kwm for code 0x%04x", kem_id);
+            else if (ech_cb->kem == NULL){
+                DBG_PRINTF("Cannot find hpke kem for code 0x%02x%02x", ech_cb->config.base[7], ech_cb->config.base[8]);
                 ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
             }
             else if (picoquic_keyex_from_key_file_fn == NULL) {
@@ -329,6 +393,147 @@ static int ech_init_opener_callback(ech_opener_callback_t** p_ech_cb, char const
     return ret;
 }
 
+/* Client cache of ECH configurations.
+*
+* The configuration list is usually the same for all connections to a
+* given server. The client parses it once, selects the first configuration
+* that uses a supported KEM and cipher suite, as picotls would do, and
+* remembers the result. Connections then pass only the selected
+* configuration to picotls. If no configuration is usable, the original
+* list is passed, and picotls will send a grease extension.
+*/
+typedef struct st_picoquic_ech_client_config_t {
+    uint8_t* config_list;
+    size_t config_list_len;
+    uint8_t* selected;
+    size_t selected_len;
+} picoquic_ech_client_config_t;
+
+struct st_picoquic_ech_client_cache_t {
+    picoquic_ech_client_config_t entry[PICOQUIC_ECH_CLIENT_CACHE_MAX];
+    size_t nb_entries;
+    size_t next_entry;
+    uint64_t nb_hits;
+};
+
+static void ech_client_config_clear(picoquic_ech_client_config_t* entry)
+{
+    if (entry->selected != NULL && entry->selected != entry->config_list) {
+        free(entry->selected);
+    }
+    if (entry->config_list != NULL) {
+        free(entry->config_list);
+    }
+    memset(entry, 0, sizeof(picoquic_ech_client_config_t));
+}
+
+static void ech_client_cache_free(picoquic_quic_t* quic)
+{
+    if (quic->ech_client_cache != NULL) {
+        for (size_t i = 0; i < quic->ech_client_cache->nb_entries; i++) {
+            ech_client_config_clear(&quic->ech_client_cache->entry[i]);
+        }
+        free(quic->ech_client_cache);
+        quic->ech_client_cache = NULL;
+    }
+}
+
+/* Select the first usable configuration in the list, and encode it as a
+ * list of one element. */
+static int ech_client_config_select(picoquic_ech_client_config_t* entry)
+{
+    int ret = 0;
+    size_t list_end = (entry->config_list_len < 2) ? 0 : 2 + (size_t)PICOPARSE_16(entry->config_list);
+    size_t x = 2;
+
+    if (list_end > entry->config_list_len) {
+        list_end = 0;
+    }
+    entry->selected = entry->config_list;
+    entry->selected_len = entry->config_list_len;
+
+    while (x + 4 <= list_end) {
+        uint8_t config_id;
+        ptls_hpke_kem_t* kem;
+        ptls_hpke_cipher_suite_t* ciphers[PICOQUIC_HPKE_CIPHER_SUITE_NB_MAX + 1];
+        size_t config_len = ech_parse_config(entry->config_list + x, list_end - x, &config_id, &kem,
+            ciphers, PICOQUIC_HPKE_CIPHER_SUITE_NB_MAX);
+
+        if (config_len == 0) {
+            /* Skip configurations of unknown versions */
+            config_len = 4 + (size_t)PICOPARSE_16(entry->config_list + x + 2);
+        }
+        else if (kem != NULL && ciphers[0] != NULL) {
+            if (config_len + 2 < entry->config_list_len) {
+                if ((entry->selected = (uint8_t*)malloc(config_len + 2)) == NULL) {
+                    entry->selected = entry->config_list;
+                    ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    picoformat_16(entry->selected, (uint16_t)config_len);
+                    memcpy(entry->selected + 2, entry->config_list + x, config_len);
+                    entry->selected_len = config_len + 2;
+                }
+            }
+            break;
+        }
+        x += config_len;
+    }
+
+    return ret;
+}
+
+static picoquic_ech_client_config_t* ech_client_cache_get(picoquic_quic_t* quic, const uint8_t* config_data, size_t config_length)
+{
+    picoquic_ech_client_config_t* entry = NULL;
+    picoquic_ech_client_cache_t* cache = quic->ech_client_cache;
+
+    if (cache == NULL) {
+        cache = (picoquic_ech_client_cache_t*)malloc(sizeof(picoquic_ech_client_cache_t));
+        if (cache != NULL) {
+            memset(cache, 0, sizeof(picoquic_ech_client_cache_t));
+            quic->ech_client_cache = cache;
+        }
+    }
+
+    if (cache != NULL) {
+        for (size_t i = 0; i < cache->nb_entries; i++) {
+            if (cache->entry[i].config_list_len == config_length &&
+                memcmp(cache->entry[i].config_list, config_data, config_length) == 0) {
+                entry = &cache->entry[i];
+                cache->nb_hits++;
+                break;
+            }
+        }
+        if (entry == NULL) {
+            /* Replace the entries in round robin order */
+            if (cache->nb_entries < PICOQUIC_ECH_CLIENT_CACHE_MAX) {
+                entry = &cache->entry[cache->nb_entries++];
+            }
+            else {
+                entry = &cache->entry[cache->next_entry];
+                cache->next_entry = (cache->next_entry + 1) % PICOQUIC_ECH_CLIENT_CACHE_MAX;
+                ech_client_config_clear(entry);
+            }
+            if ((entry->config_list = (uint8_t*)malloc(config_length)) != NULL) {
+                memcpy(entry->config_list, config_data, config_length);
+                entry->config_list_len = config_length;
+            }
+            if (entry->config_list == NULL || ech_client_config_select(entry) != 0) {
+                ech_client_config_clear(entry);
+                entry = NULL;
+            }
+        }
+    }
+
+    return entry;
+}
+
+uint64_t picoquic_ech_get_client_cache_hits(picoquic_quic_t* quic)
+{
+    return (quic->ech_client_cache == NULL) ? 0 : quic->ech_client_cache->nb_hits;
+}
+
 /* Configure a QUIC context for ECH
 *
 * For both clients and servers, document:
@@ -380,8 +585,10 @@ void picoquic_release_quic_ech_ctx(picoquic_quic_t* quic)
 
         if (ech_cb != NULL) {
             ech_dispose_opener_callback(ech_cb);
+            ctx->ech.server.create_opener = NULL;
         }
     }
+    ech_client_cache_free(quic);
 }
 
 /* Configure a tls connection context on the client side:
@@ -393,6 +600,12 @@ int picoquic_ech_configure_client(picoquic_cnx_t* cnx, const uint8_t * config_da
 {
     int ret = 0;
     picoquic_tls_ctx_t* tls_ctx = (picoquic_tls_ctx_t*)cnx->tls_ctx;
+    picoquic_ech_client_config_t* entry = ech_client_cache_get(cnx->quic, config_data, config_length);
+
+    if (entry != NULL) {
+        config_data = entry->selected;
+        config_length = entry->selected_len;
+    }
     tls_ctx->handshake_properties.client.ech.configs.base = (uint8_t*)malloc(config_length);
     if (tls_ctx->handshake_properties.client.ech.configs.base == NULL) {
         ret = PICOQUIC_ERROR_MEMORY;
@@ -0,0 +1,340 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Egress scheduler.
+*
+* Without the scheduler, the quic context serves the connections in order
+* of wake time. That order is fair between connections, but not between
+* the applications or tenants that share a server: the one with the most
+* connections, or with the connections sending the most data, gets most
+* of the output. The scheduler sorts the connections in groups, and
+* applies the classic combination of strict priority, deficit round robin
+* and token buckets between the groups.
+*
+* Connections that are due to send are removed from the wake list and
+* appended to the ready queue of their group. When a group is selected,
+* the first connection in its queue prepares packets, and is then put back
+* in the wake list by picoquic_prepare_packet_ex, as usual. If it still has
+* something to send, it will come back at the end of the ready queue, which
+* implements the round robin between the connections of a group. Deficits
+* and credits are charged with the actual size of the prepared trains, so
+* large GSO trains are accounted for.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+int picoquic_set_egress_scheduler(picoquic_quic_t* quic, int enable, picoquic_egress_group_fn group_fn, void* group_ctx)
+{
+    int ret = 0;
+
+    if (!enable) {
+        picoquic_egress_free(quic);
+    }
+    else {
+        if (quic->egress == NULL) {
+            quic->egress = (picoquic_egress_ctx_t*)malloc(sizeof(picoquic_egress_ctx_t));
+            if (quic->egress == NULL) {
+                DBG_PRINTF("%s", "Cannot allocate the egress scheduler\n");
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                memset(quic->egress, 0, sizeof(picoquic_egress_ctx_t));
+                quic->egress->nb_groups = 1;
+                for (int i = 0; i < PICOQUIC_EGRESS_MAX_GROUPS; i++) {
+                    quic->egress->group[i].quantum = PICOQUIC_EGRESS_QUANTUM_DEFAULT;
+                }
+            }
+        }
+        if (ret == 0) {
+            quic->egress->group_fn = group_fn;
+            quic->egress->group_ctx = group_ctx;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_set_egress_group(picoquic_quic_t* quic, int group_id, char const* alpn, int is_priority,
+    uint64_t quantum, uint64_t rate, uint64_t burst)
+{
+    int ret = 0;
+
+    if (quic->egress == NULL || group_id < 0 || group_id >= PICOQUIC_EGRESS_MAX_GROUPS) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else {
+        picoquic_egress_group_t* group = &quic->egress->group[group_id];
+
+        group->alpn = picoquic_string_free(group->alpn);
+        if (alpn != NULL && (group->alpn = picoquic_string_duplicate(alpn)) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        group->is_priority = is_priority;
+        /* A quantum smaller than a packet would only cost more rounds */
+        group->quantum = (quantum == 0) ? PICOQUIC_EGRESS_QUANTUM_DEFAULT :
+            ((quantum < PICOQUIC_MAX_PACKET_SIZE) ? PICOQUIC_MAX_PACKET_SIZE : quantum);
+        group->rate = rate;
+        group->burst = (burst < PICOQUIC_MAX_PACKET_SIZE) ? PICOQUIC_MAX_PACKET_SIZE : burst;
+        group->credit = (int64_t)(group->burst * 1000000ull);
+        group->last_time = 0;
+        if (group_id >= quic->egress->nb_groups) {
+            quic->egress->nb_groups = group_id + 1;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_get_egress_group_stats(picoquic_quic_t* quic, int group_id, picoquic_egress_group_stats_t* stats)
+{
+    int ret = 0;
+
+    if (quic->egress == NULL || group_id < 0 || group_id >= quic->egress->nb_groups) {
+        memset(stats, 0, sizeof(picoquic_egress_group_stats_t));
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else {
+        *stats = quic->egress->group[group_id].stats;
+    }
+
+    return ret;
+}
+
+static int picoquic_egress_classify(picoquic_egress_ctx_t* egress, picoquic_cnx_t* cnx)
+{
+    int group_id = -1;
+
+    if (egress->group_fn != NULL) {
+        group_id = egress->group_fn(cnx, egress->group_ctx);
+    }
+    if (group_id < 0 || group_id >= egress->nb_groups) {
+        group_id = 0;
+        if (cnx->alpn != NULL) {
+            for (int i = 0; i < egress->nb_groups; i++) {
+                if (egress->group[i].alpn != NULL && strcmp(egress->group[i].alpn, cnx->alpn) == 0) {
+                    group_id = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    return group_id;
+}
+
+static void picoquic_egress_enqueue(picoquic_egress_ctx_t* egress, picoquic_cnx_t* cnx)
+{
+    int group_id = picoquic_egress_classify(egress, cnx);
+    picoquic_egress_group_t* group = &egress->group[group_id];
+
+    cnx->egress_group = group_id;
+    cnx->egress_next = NULL;
+    cnx->egress_previous = group->last_ready;
+    if (group->last_ready == NULL) {
+        group->first_ready = cnx;
+    }
+    else {
+        group->last_ready->egress_next = cnx;
+    }
+    group->last_ready = cnx;
+    group->stats.nb_ready++;
+    cnx->is_egress_queued = 1;
+}
+
+void picoquic_egress_unqueue(picoquic_cnx_t* cnx)
+{
+    picoquic_egress_group_t* group = &cnx->quic->egress->group[cnx->egress_group];
+
+    if (cnx->egress_previous == NULL) {
+        group->first_ready = cnx->egress_next;
+    }
+    else {
+        cnx->egress_previous->egress_next = cnx->egress_next;
+    }
+    if (cnx->egress_next == NULL) {
+        group->last_ready = cnx->egress_previous;
+    }
+    else {
+        cnx->egress_next->egress_previous = cnx->egress_previous;
+    }
+    cnx->egress_next = NULL;
+    cnx->egress_previous = NULL;
+    group->stats.nb_ready--;
+    cnx->is_egress_queued = 0;
+}
+
+static void picoquic_egress_refill(picoquic_egress_group_t* group, uint64_t current_time)
+{
+    if (group->rate > 0) {
+        int64_t credit_max = (int64_t)(group->burst * 1000000ull);
+
+        if (group->last_time == 0 || current_time >= group->last_time + 1000000) {
+            if (group->credit < credit_max) {
+                group->credit = credit_max;
+            }
+        }
+        else if (current_time > group->last_time) {
+            group->credit += (int64_t)((current_time - group->last_time) * group->rate);
+            if (group->credit > credit_max) {
+                group->credit = credit_max;
+            }
+        }
+        group->last_time = current_time;
+    }
+}
+
+static int picoquic_egress_is_eligible(picoquic_egress_group_t* group)
+{
+    return group->rate == 0 || group->credit > 0;
+}
+
+picoquic_cnx_t* picoquic_egress_select(picoquic_quic_t* quic, uint64_t current_time)
+{
+    picoquic_egress_ctx_t* egress = quic->egress;
+    picoquic_cnx_t* cnx;
+    picoquic_cnx_t* selected = NULL;
+    int nb_candidates = 0;
+
+    /* Move the connections that are due to the queues of their groups */
+    while ((cnx = picoquic_get_earliest_cnx_to_wake(quic, current_time)) != NULL &&
+        cnx->next_wake_time <= current_time) {
+        picoquic_remove_cnx_from_wake_list(cnx);
+        picoquic_egress_enqueue(egress, cnx);
+    }
+
+    for (int i = 0; i < egress->nb_groups; i++) {
+        picoquic_egress_group_t* group = &egress->group[i];
+
+        picoquic_egress_refill(group, current_time);
+        if (group->first_ready != NULL) {
+            if (!picoquic_egress_is_eligible(group)) {
+                group->stats.nb_rate_limited++;
+            }
+            else if (group->is_priority) {
+                if (selected == NULL) {
+                    selected = group->first_ready;
+                }
+            }
+            else {
+                nb_candidates++;
+            }
+        }
+        else if (!group->is_priority) {
+            /* Idle groups do not accumulate deficit */
+            group->deficit = 0;
+        }
+    }
+
+    if (selected == NULL && nb_candidates > 0) {
+        /* Deficit round robin. Each visit adds the quantum, and the group
+         * keeps the turn while its deficit is positive. */
+        for (int step = 0; step < egress->nb_groups * 1024 && selected == NULL; step++) {
+            picoquic_egress_group_t* group = &egress->group[egress->drr_current];
+
+            if (group->first_ready != NULL && !group->is_priority && picoquic_egress_is_eligible(group)) {
+                if (group->deficit <= 0) {
+                    group->deficit += (int64_t)group->quantum;
+                }
+                if (group->deficit > 0) {
+                    selected = group->first_ready;
+                    break;
+                }
+            }
+            egress->drr_current = (egress->drr_current + 1) % egress->nb_groups;
+        }
+        if (selected == NULL) {
+            /* Cannot happen with bounded trains, but never block the output */
+            selected = egress->group[egress->drr_current].first_ready;
+        }
+    }
+
+    return selected;
+}
+
+void picoquic_egress_charge(picoquic_quic_t* quic, int group_id, size_t length, uint64_t current_time)
+{
+    picoquic_egress_ctx_t* egress = quic->egress;
+
+    if (egress != NULL && length > 0 && group_id >= 0 && group_id < egress->nb_groups) {
+        picoquic_egress_group_t* group = &egress->group[group_id];
+
+        group->stats.bytes_sent += length;
+        group->stats.nb_trains_sent++;
+        if (group->rate > 0) {
+            picoquic_egress_refill(group, current_time);
+            group->credit -= (int64_t)(length * 1000000ull);
+        }
+        if (!group->is_priority) {
+            group->deficit -= (int64_t)length;
+            if (group->deficit <= 0 && egress->drr_current == group_id) {
+                egress->drr_current = (egress->drr_current + 1) % egress->nb_groups;
+            }
+        }
+    }
+}
+
+/* Time at which a queued connection can be served, or UINT64_MAX if none is queued */
+uint64_t picoquic_egress_next_time(picoquic_quic_t* quic, uint64_t current_time)
+{
+    picoquic_egress_ctx_t* egress = quic->egress;
+    uint64_t next_time = UINT64_MAX;
+
+    for (int i = 0; i < egress->nb_groups && next_time > current_time; i++) {
+        picoquic_egress_group_t* group = &egress->group[i];
+
+        if (group->first_ready != NULL) {
+            picoquic_egress_refill(group, current_time);
+            if (picoquic_egress_is_eligible(group)) {
+                next_time = current_time;
+            }
+            else {
+                uint64_t eligible_time = current_time + ((uint64_t)(-group->credit)) / group->rate + 1;
+                if (eligible_time < next_time) {
+                    next_time = eligible_time;
+                }
+            }
+        }
+    }
+
+    return next_time;
+}
+
+void picoquic_egress_free(picoquic_quic_t* quic)
+{
+    picoquic_egress_ctx_t* egress = quic->egress;
+
+    if (egress != NULL) {
+        for (int i = 0; i < PICOQUIC_EGRESS_MAX_GROUPS; i++) {
+            /* Put the ready connections back in the wake list */
+            while (egress->group[i].first_ready != NULL) {
+                picoquic_cnx_t* cnx = egress->group[i].first_ready;
+                picoquic_reinsert_by_wake_time(quic, cnx, cnx->next_wake_time);
+            }
+            egress->group[i].alpn = picoquic_string_free(egress->group[i].alpn);
+        }
+        free(egress);
+        quic->egress = NULL;
+    }
+}
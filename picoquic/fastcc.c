@@ -325,6 +325,56 @@ void picoquic_fastcc_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint64
     *cc_param = fastcc_state->rolling_rtt_min;
 }
 
+/* Export and import the state of congestion control.
+ * The snapshot carries the RTT min estimates. A path that was frozen
+ * after a congestion event resumes in the evaluation state.
+ */
+static uint8_t* picoquic_fastcc_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_fastcc_state_t* fastcc_state = (picoquic_fastcc_state_t*)path_x->congestion_alg_state;
+    uint64_t values[4];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    values[0] = (uint64_t)fastcc_state->alg_state;
+    values[1] = fastcc_state->rtt_min;
+    values[2] = fastcc_state->rolling_rtt_min;
+    values[3] = fastcc_state->rtt_min_is_trusted;
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 4);
+}
+
+static const uint8_t* picoquic_fastcc_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_fastcc_state_t* fastcc_state = (picoquic_fastcc_state_t*)path_x->congestion_alg_state;
+    uint64_t values[4];
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 4)) != NULL) {
+        if (values[0] > picoquic_fastcc_freeze || values[1] == 0) {
+            bytes = NULL;
+        }
+        else {
+            fastcc_state->alg_state = (values[0] == picoquic_fastcc_initial) ? picoquic_fastcc_initial : picoquic_fastcc_eval;
+            fastcc_state->rtt_min = values[1];
+            fastcc_state->rolling_rtt_min = values[2];
+            fastcc_state->rtt_min_is_trusted = (values[3] != 0);
+            for (int i = 0; i < FASTCC_NB_PERIOD; i++) {
+                fastcc_state->last_rtt_min[i] = 0;
+            }
+            fastcc_state->delay_threshold = picoquic_fastcc_delay_threshold(fastcc_state->rtt_min);
+            fastcc_state->end_of_epoch = current_time + FASTCC_PERIOD;
+            fastcc_state->end_of_freeze = current_time;
+            fastcc_state->nb_bytes_ack = 0;
+            fastcc_state->nb_bytes_ack_since_rtt = 0;
+            fastcc_state->recovery_sequence = picoquic_cc_get_sequence_number(cnx, path_x);
+            picoquic_update_pacing_data(cnx, path_x, fastcc_state->alg_state == picoquic_fastcc_initial);
+        }
+    }
+
+    return bytes;
+}
+
 /* Definition record for the FAST CC algorithm */
 
 #define picoquic_fastcc_ID "fast" 
@@ -334,7 +384,9 @@ picoquic_congestion_algorithm_t picoquic_fastcc_algorithm_struct = {
     picoquic_fastcc_init,
     picoquic_fastcc_notify,
     picoquic_fastcc_delete,
-    picoquic_fastcc_observe
+    picoquic_fastcc_observe,
+    picoquic_fastcc_export,
+    picoquic_fastcc_import
 };
 
 picoquic_congestion_algorithm_t* picoquic_fastcc_algorithm = &picoquic_fastcc_algorithm_struct;
@@ -0,0 +1,370 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Experimental forward error correction.
+*
+* The sender groups the ack-eliciting 1-RTT packets that it sends in blocks
+* of up to fec_block_size packets, and computes the XOR of their payloads,
+* after padding. When the block is complete, a FEC_REPAIR frame is sent:
+*
+*     FEC_REPAIR Frame {
+*       Type (i) = 0xfec0,
+*       First Packet Number (i),
+*       Packet Mask (i),
+*       Length XOR (i),
+*       Symbol Length (i),
+*       Repair Symbol (..)
+*     }
+*
+* Bit N of the packet mask is set if packet number "first + N" is part of the
+* block. The length XOR is the XOR of the payload lengths, and the repair
+* symbol is the XOR of the payloads, each padded with zeroes to the symbol
+* length. The repair frame does not elicit acknowledgements, and is never
+* retransmitted.
+*
+* The receiver keeps a copy of the payloads of the last packets received.
+* If a single packet of a block is missing, it is rebuilt from the repair
+* frame and the other payloads, its frames are processed, and its packet
+* number is acknowledged as if the packet had been received. On the sender
+* side, the loss detection leaves time for that to happen before declaring
+* protected packets lost, so that repaired losses cause neither
+* retransmissions nor congestion signals.
+*
+* Packets sent more than a quarter of RTT apart close the block early, so
+* that the repair is not delayed for sparse, interactive traffic. Payloads
+* too long to fit a repair frame in a packet of the same size are not
+* protected. The extension is negotiated with the enable_fec transport
+* parameter, and is not used on multipath connections.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+void picoquic_set_default_fec_option(picoquic_quic_t* quic, uint8_t block_size)
+{
+    quic->default_fec_block_size = (block_size > PICOQUIC_FEC_WINDOW_MAX) ? PICOQUIC_FEC_WINDOW_MAX : block_size;
+}
+
+void picoquic_get_fec_stats(picoquic_cnx_t* cnx, uint64_t* nb_repairs_sent, uint64_t* nb_packets_recovered)
+{
+    *nb_repairs_sent = cnx->nb_fec_repairs_sent;
+    *nb_packets_recovered = cnx->nb_fec_packets_recovered;
+}
+
+void picoquic_fec_free(picoquic_cnx_t* cnx)
+{
+    if (cnx->fec_sender != NULL) {
+        free(cnx->fec_sender);
+        cnx->fec_sender = NULL;
+    }
+    if (cnx->fec_receiver != NULL) {
+        free(cnx->fec_receiver);
+        cnx->fec_receiver = NULL;
+    }
+}
+
+/* Sender side.
+ * The repair frame is prepared when the block is closed, and sent with the
+ * next packet. If a new block is closed before that, the older repair frame
+ * is replaced.
+ */
+static void picoquic_fec_close_block(picoquic_cnx_t* cnx, picoquic_fec_sender_t* fec)
+{
+    uint8_t* bytes = fec->repair_frame;
+    uint8_t* bytes_max = fec->repair_frame + sizeof(fec->repair_frame);
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_frame_type_fec_repair)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, fec->first_pn)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, fec->pn_mask)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, fec->length_xor)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, fec->symbol_length)) != NULL &&
+        bytes + fec->symbol_length <= bytes_max) {
+        memcpy(bytes, fec->symbol, fec->symbol_length);
+        bytes += fec->symbol_length;
+        fec->repair_length = bytes - fec->repair_frame;
+        cnx->nb_fec_repairs_sent++;
+    }
+    fec->nb_symbols = 0;
+}
+
+void picoquic_fec_add_source(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_t* packet,
+    size_t header_length, size_t payload_length, size_t checksum_overhead, uint64_t current_time)
+{
+    picoquic_fec_sender_t* fec = cnx->fec_sender;
+
+    if (payload_length + header_length + checksum_overhead + PICOQUIC_FEC_REPAIR_OVERHEAD > path_x->send_mtu ||
+        payload_length + PICOQUIC_FEC_REPAIR_OVERHEAD > PICOQUIC_MAX_PACKET_SIZE ||
+        !picoquic_is_packet_ack_eliciting(packet)) {
+        return;
+    }
+
+    if (fec == NULL) {
+        fec = (picoquic_fec_sender_t*)malloc(sizeof(picoquic_fec_sender_t));
+        if (fec == NULL) {
+            return;
+        }
+        memset(fec, 0, sizeof(picoquic_fec_sender_t));
+        cnx->fec_sender = fec;
+    }
+
+    if (fec->nb_symbols > 0 &&
+        (packet->sequence_number >= fec->first_pn + PICOQUIC_FEC_WINDOW_MAX ||
+            current_time > fec->first_time + (path_x->smoothed_rtt / 4))) {
+        picoquic_fec_close_block(cnx, fec);
+    }
+
+    if (fec->nb_symbols == 0) {
+        fec->first_pn = packet->sequence_number;
+        fec->first_time = current_time;
+        fec->pn_mask = 0;
+        fec->length_xor = 0;
+        fec->symbol_length = 0;
+    }
+
+    if (payload_length > fec->symbol_length) {
+        memset(fec->symbol + fec->symbol_length, 0, payload_length - fec->symbol_length);
+        fec->symbol_length = payload_length;
+    }
+    for (size_t i = 0; i < payload_length; i++) {
+        fec->symbol[i] ^= packet->bytes[header_length + i];
+    }
+    fec->pn_mask |= 1ull << (packet->sequence_number - fec->first_pn);
+    fec->length_xor ^= payload_length;
+    fec->nb_symbols++;
+    packet->is_fec_protected = 1;
+
+    if (fec->nb_symbols >= cnx->fec_block_size) {
+        picoquic_fec_close_block(cnx, fec);
+    }
+}
+
+uint8_t* picoquic_format_fec_repair_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
+    int* more_data, int* is_pure_ack)
+{
+    picoquic_fec_sender_t* fec = cnx->fec_sender;
+
+    if (fec != NULL && fec->repair_length > 0) {
+        if (bytes + fec->repair_length <= bytes_max) {
+            memcpy(bytes, fec->repair_frame, fec->repair_length);
+            bytes += fec->repair_length;
+            fec->repair_length = 0;
+        }
+        else {
+            *more_data = 1;
+        }
+    }
+    /* The repair frame does not elicit acknowledgements */
+    (void)is_pure_ack;
+
+    return bytes;
+}
+
+/* Loss detection. A protected packet is not declared lost by the packet
+ * threshold before the peer had time to receive the repair frame,
+ * rebuild the packet and acknowledge it. */
+uint64_t picoquic_fec_recovery_deadline(picoquic_cnx_t* cnx, picoquic_packet_t* old_p)
+{
+    uint64_t rack_delay = old_p->send_path->smoothed_rtt / 4;
+
+    if (rack_delay > PICOQUIC_RACK_DELAY / 2) {
+        rack_delay = PICOQUIC_RACK_DELAY / 2;
+    }
+    return old_p->send_time + old_p->send_path->smoothed_rtt + rack_delay + cnx->remote_parameters.max_ack_delay;
+}
+
+/* Receiver side */
+const uint8_t* picoquic_skip_fec_repair_frame(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    uint64_t symbol_length = 0;
+
+    if ((bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL &&
+        (bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL &&
+        (bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &symbol_length)) != NULL) {
+        bytes = picoquic_frames_fixed_skip(bytes, bytes_max, symbol_length);
+    }
+    return bytes;
+}
+
+static picoquic_fec_receiver_t* picoquic_fec_get_receiver(picoquic_cnx_t* cnx)
+{
+    if (cnx->fec_receiver == NULL) {
+        cnx->fec_receiver = (picoquic_fec_receiver_t*)malloc(sizeof(picoquic_fec_receiver_t));
+        if (cnx->fec_receiver != NULL) {
+            memset(cnx->fec_receiver, 0, sizeof(picoquic_fec_receiver_t));
+        }
+    }
+    return cnx->fec_receiver;
+}
+
+const uint8_t* picoquic_decode_fec_repair_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    uint64_t first_pn = 0;
+    uint64_t pn_mask = 0;
+    uint64_t length_xor = 0;
+    uint64_t symbol_length = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &first_pn)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &pn_mask)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &length_xor)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &symbol_length)) == NULL ||
+        (pn_mask & 1) == 0 || pn_mask >= (1ull << PICOQUIC_FEC_WINDOW_MAX) ||
+        symbol_length > PICOQUIC_MAX_PACKET_SIZE || length_xor >= 2 * PICOQUIC_MAX_PACKET_SIZE ||
+        bytes + symbol_length > bytes_max) {
+        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, picoquic_frame_type_fec_repair);
+        bytes = NULL;
+    }
+    else if (!cnx->is_fec_negotiated) {
+        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, picoquic_frame_type_fec_repair);
+        bytes = NULL;
+    }
+    else {
+        picoquic_fec_receiver_t* fec = picoquic_fec_get_receiver(cnx);
+
+        if (fec != NULL) {
+            picoquic_fec_repair_t* repair = &fec->repairs[fec->next_repair];
+
+            fec->next_repair = (fec->next_repair + 1) % PICOQUIC_FEC_REPAIRS_MAX;
+            repair->first_pn = first_pn;
+            repair->pn_mask = pn_mask;
+            repair->length_xor = length_xor;
+            repair->symbol_length = (size_t)symbol_length;
+            memcpy(repair->symbol, bytes, (size_t)symbol_length);
+            repair->is_valid = 1;
+        }
+        bytes += symbol_length;
+    }
+
+    return bytes;
+}
+
+static void picoquic_fec_cache_symbol(picoquic_fec_receiver_t* fec, uint64_t pn, const uint8_t* payload, size_t length)
+{
+    picoquic_fec_symbol_t* symbol = &fec->cache[pn % PICOQUIC_FEC_CACHE_SIZE];
+
+    if (length <= sizeof(symbol->bytes) && (!symbol->is_valid || symbol->pn < pn)) {
+        symbol->pn = pn;
+        symbol->length = length;
+        memcpy(symbol->bytes, payload, length);
+        symbol->is_valid = 1;
+    }
+    if (pn > fec->highest_pn) {
+        fec->highest_pn = pn;
+    }
+}
+
+static picoquic_fec_symbol_t* picoquic_fec_find_symbol(picoquic_fec_receiver_t* fec, uint64_t pn)
+{
+    picoquic_fec_symbol_t* symbol = &fec->cache[pn % PICOQUIC_FEC_CACHE_SIZE];
+
+    return (symbol->is_valid && symbol->pn == pn) ? symbol : NULL;
+}
+
+/* Rebuild the missing packet of a repair block, process its frames, and
+ * mark its number as received. */
+static int picoquic_fec_recover(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_header* ph,
+    picoquic_fec_repair_t* repair, uint64_t missing_pn, struct sockaddr* addr_from, struct sockaddr* addr_to,
+    uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_fec_receiver_t* fec = cnx->fec_receiver;
+    uint8_t recovered[PICOQUIC_MAX_PACKET_SIZE];
+    uint64_t length = repair->length_xor;
+    int is_consistent = 1;
+
+    memcpy(recovered, repair->symbol, repair->symbol_length);
+    for (int i = 0; is_consistent && i < PICOQUIC_FEC_WINDOW_MAX; i++) {
+        uint64_t pn = repair->first_pn + i;
+
+        if ((repair->pn_mask & (1ull << i)) != 0 && pn != missing_pn) {
+            picoquic_fec_symbol_t* symbol = picoquic_fec_find_symbol(fec, pn);
+
+            if (symbol == NULL || symbol->length > repair->symbol_length) {
+                is_consistent = 0;
+            }
+            else {
+                for (size_t j = 0; j < symbol->length; j++) {
+                    recovered[j] ^= symbol->bytes[j];
+                }
+                length ^= symbol->length;
+            }
+        }
+    }
+
+    if (is_consistent && length > 0 && length <= repair->symbol_length) {
+        ret = picoquic_decode_frames(cnx, path_x, recovered, (size_t)length, NULL, picoquic_epoch_1rtt,
+            addr_from, addr_to, missing_pn, 0, current_time);
+        if (ret == 0) {
+            ret = picoquic_record_pn_received(cnx, picoquic_packet_context_application, ph->l_cid,
+                missing_pn, current_time);
+            picoquic_fec_cache_symbol(fec, missing_pn, recovered, (size_t)length);
+            cnx->nb_fec_packets_recovered++;
+            picoquic_log_app_message(cnx, "FEC recovered packet %" PRIu64, missing_pn);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_fec_incoming_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_header* ph,
+    const uint8_t* payload, struct sockaddr* addr_from, struct sockaddr* addr_to, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_fec_receiver_t* fec = picoquic_fec_get_receiver(cnx);
+
+    if (fec == NULL) {
+        return 0;
+    }
+
+    picoquic_fec_cache_symbol(fec, ph->pn64, payload, ph->payload_length);
+
+    for (int r = 0; ret == 0 && r < PICOQUIC_FEC_REPAIRS_MAX; r++) {
+        picoquic_fec_repair_t* repair = &fec->repairs[r];
+        uint64_t missing_pn = 0;
+        int nb_missing = 0;
+
+        if (!repair->is_valid) {
+            continue;
+        }
+        for (int i = 0; i < PICOQUIC_FEC_WINDOW_MAX; i++) {
+            if ((repair->pn_mask & (1ull << i)) != 0 &&
+                picoquic_fec_find_symbol(fec, repair->first_pn + i) == NULL) {
+                missing_pn = repair->first_pn + i;
+                nb_missing++;
+            }
+        }
+
+        if (nb_missing == 1) {
+            repair->is_valid = 0;
+            if (!picoquic_is_pn_already_received(cnx, picoquic_packet_context_application, ph->l_cid, missing_pn)) {
+                ret = picoquic_fec_recover(cnx, path_x, ph, repair, missing_pn, addr_from, addr_to, current_time);
+            }
+        }
+        else if (nb_missing == 0 || repair->first_pn + PICOQUIC_FEC_CACHE_SIZE <= fec->highest_pn) {
+            /* Nothing to repair, or too late to repair */
+            repair->is_valid = 0;
+        }
+    }
+
+    return ret;
+}
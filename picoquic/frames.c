@@ -25,6 +25,7 @@
 #include <string.h>
 #include "picoquic_internal.h"
 #include "tls_api.h"
+#include "picoquic_probes.h"
 
 static const size_t challenge_length = 8;
 
@@ -194,6 +195,57 @@ picoquic_stream_head_t* picoquic_find_or_create_stream(picoquic_cnx_t* cnx, uint
  * when a new max offset is learnt for a stream.
  */
 
+/* Receive window autotuning. Measure how much data is received during
+ * each RTT, and set the window to twice that amount, so the window can
+ * double every RTT while the peer is limited by flow control. The window
+ * starts at the initial credit and never shrinks. It is capped by the
+ * configured maximum and by the connection memory budget.
+ */
+static void picoquic_rcv_autotune_update(picoquic_cnx_t* cnx, picoquic_rcv_autotune_t* tune,
+    uint64_t offset, uint64_t limit, uint64_t current_time)
+{
+    if (tune->epoch_time == 0) {
+        tune->epoch_time = current_time;
+        tune->epoch_offset = offset;
+        if (limit > offset) {
+            tune->window = limit - offset;
+        }
+    }
+    else {
+        uint64_t rtt = cnx->path[0]->smoothed_rtt;
+
+        if (current_time >= tune->epoch_time + rtt) {
+            uint64_t target = 2 * (offset - tune->epoch_offset);
+            uint64_t window_max = cnx->quic->rcv_window_max;
+
+            if (cnx->memory_budget != 0 && window_max > cnx->memory_budget) {
+                window_max = cnx->memory_budget;
+            }
+            if (target > window_max) {
+                target = window_max;
+            }
+            if (target > tune->window) {
+                tune->window = target;
+            }
+            tune->epoch_time = current_time;
+            tune->epoch_offset = offset;
+        }
+    }
+}
+
+/* Compute the new limit for an autotuned window, or 0 if the remaining
+ * credit is still larger than half the window. */
+static uint64_t picoquic_rcv_autotune_new_limit(picoquic_rcv_autotune_t* tune, uint64_t offset, uint64_t limit)
+{
+    uint64_t new_limit = 0;
+
+    if (offset + tune->window / 2 > limit) {
+        new_limit = offset + tune->window;
+    }
+
+    return new_limit;
+}
+
 int picoquic_flow_control_check_stream_offset(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
     uint64_t new_fin_offset)
 {
@@ -212,6 +264,10 @@ int picoquic_flow_control_check_stream_offset(picoquic_cnx_t* cnx, picoquic_stre
             /* protocol violation */
             ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FLOW_CONTROL_ERROR, 0);
         } else {
+            if (cnx->quic->rcv_window_max != 0) {
+                picoquic_rcv_autotune_update(cnx, &cnx->rcv_autotune, cnx->data_received, cnx->maxdata_local,
+                    picoquic_get_quic_time(cnx->quic));
+            }
             cnx->data_received += new_bytes;
             stream->fin_offset = new_fin_offset;
         }
@@ -247,12 +303,11 @@ uint8_t * picoquic_format_stream_reset_frame(picoquic_cnx_t* cnx, picoquic_strea
             while (stream->send_queue != NULL) {
                 picoquic_stream_queue_node_t* next = stream->send_queue->next_stream_data;
 
-                if (stream->send_queue->bytes != NULL) {
-                    free(stream->send_queue->bytes);
-                }
-                free(stream->send_queue);
+                picoquic_stream_queue_node_free(cnx, stream->send_queue);
                 stream->send_queue = next;
             }
+            picoquic_stream_retained_free(cnx, stream);
+            picoquic_send_backlog_discard(cnx, stream);
             (void)picoquic_delete_stream_if_closed(cnx, stream);
         }
         else {
@@ -386,7 +441,7 @@ uint8_t * picoquic_format_new_connection_id_frame(picoquic_cnx_t* cnx, picoquic_
     int * more_data, int * is_pure_ack, picoquic_local_cnxid_t* l_cid)
 {
     uint8_t* bytes0 = bytes;
-    unsigned int is_mp = cnx->is_multipath_enabled;
+    unsigned int is_mp = PICOQUIC_CNX_IS_MULTIPATH(cnx);
 
     if (l_cid != NULL && l_cid->cnx_id.id_len > 0) {
         if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, 
@@ -459,7 +514,7 @@ const uint8_t* picoquic_decode_new_connection_id_frame(picoquic_cnx_t* cnx, cons
     const uint8_t* cnxid_bytes = NULL;
     const uint8_t* secret_bytes = NULL;
 
-    if (is_mp && !cnx->is_multipath_enabled) {
+    if (is_mp && !PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             picoquic_frame_type_path_new_connection_id);
         bytes = NULL;
@@ -481,7 +536,7 @@ const uint8_t* picoquic_decode_new_connection_id_frame(picoquic_cnx_t* cnx, cons
         bytes = NULL;
     }
     else if (unique_path_id > cnx->max_path_id_local &&
-        cnx->is_multipath_enabled) {
+        PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* Error -- the peer is not authorized to use this path ID */
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             (is_mp) ? picoquic_frame_type_path_new_connection_id : picoquic_frame_type_new_connection_id);
@@ -638,7 +693,7 @@ int picoquic_queue_retire_connection_id_frame(picoquic_cnx_t * cnx, uint64_t uni
     int is_pure_ack = 1;
     int more_data = 0;
     uint8_t * bytes_next = picoquic_format_retire_connection_id_frame(frame_buffer, frame_buffer + sizeof(frame_buffer),
-        &more_data, &is_pure_ack, cnx->is_multipath_enabled, unique_path_id, sequence);
+        &more_data, &is_pure_ack, PICOQUIC_CNX_IS_MULTIPATH(cnx), unique_path_id, sequence);
     
     if ((consumed = bytes_next - frame_buffer) > 0) {
         ret = picoquic_queue_misc_frame(cnx, frame_buffer, consumed, is_pure_ack,
@@ -695,7 +750,7 @@ const uint8_t* picoquic_decode_retire_connection_id_frame(picoquic_cnx_t* cnx, c
     uint64_t sequence;
     uint64_t unique_path_id;
 
-    if (is_mp && !cnx->is_multipath_enabled) {
+    if (is_mp && !PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             picoquic_frame_type_path_retire_connection_id);
         bytes = NULL;
@@ -744,15 +799,9 @@ int picoquic_check_retire_connection_id_needs_repeat(picoquic_cnx_t* cnx, const
          * Otherwise, no need to repeat the message.
          */
         picoquic_remote_cnxid_stash_t* remote_cnxid_stash = picoquic_find_or_create_remote_cnxid_stash(cnx, unique_path_id, 0);
-        if (remote_cnxid_stash != NULL) {
-            picoquic_remote_cnxid_t* stashed = remote_cnxid_stash->cnxid_stash_first;
-            while (stashed != NULL) {
-                if (stashed->sequence == sequence) {
-                    *no_need_to_repeat = stashed->retire_acked;
-                    break;
-                }
-                stashed = stashed->next;
-            }
+        picoquic_remote_cnxid_t* stashed = picoquic_find_cnxid_in_stash(remote_cnxid_stash, sequence);
+        if (stashed != NULL) {
+            *no_need_to_repeat = stashed->retire_acked;
         }
     }
 
@@ -774,16 +823,10 @@ int picoquic_process_ack_of_retire_connection_id_frame(picoquic_cnx_t* cnx, cons
         *consumed = bytes_next - bytes;
 
         picoquic_remote_cnxid_stash_t* remote_cnxid_stash = picoquic_find_or_create_remote_cnxid_stash(cnx, unique_path_id, 0);
-        if (remote_cnxid_stash != NULL) {
-            picoquic_remote_cnxid_t* stashed = remote_cnxid_stash->cnxid_stash_first;
-            while (stashed != NULL) {
-                if (stashed->sequence == sequence) {
-                    stashed->retire_acked = 1;
-                    (void)picoquic_remove_cnxid_from_stash(cnx, remote_cnxid_stash, stashed, NULL);
-                    break;
-                }
-                stashed = stashed->next;
-            }
+        picoquic_remote_cnxid_t* stashed = picoquic_find_cnxid_in_stash(remote_cnxid_stash, sequence);
+        if (stashed != NULL) {
+            stashed->retire_acked = 1;
+            (void)picoquic_remove_cnxid_from_stash(cnx, remote_cnxid_stash, stashed, NULL);
         }
     }
     else {
@@ -1048,12 +1091,134 @@ int picoquic_parse_stream_header(const uint8_t* bytes, size_t bytes_max,
     return ret;
 }
 
+/* Check whether "bytes" points inside the decrypted packet buffer */
+static int picoquic_is_in_data_node(picoquic_stream_data_node_t* node, const uint8_t* bytes, size_t length)
+{
+    return (node != NULL && bytes >= node->data && length <= node->data_max &&
+        (size_t)(bytes - node->data) <= node->data_max - length);
+}
+
+/* Reassembly ring management. The bit operations on the "received" bitmap
+ * do not wrap around the end of the ring, the callers split the ranges.
+ */
+static void picoquic_reassembly_ring_mark(uint64_t* bits, size_t pos, size_t length, int is_set)
+{
+    while (length > 0) {
+        size_t bit = pos & 63;
+        size_t nb_bits = 64 - bit;
+        uint64_t mask;
+
+        if (nb_bits > length) {
+            nb_bits = length;
+        }
+        mask = (nb_bits == 64) ? UINT64_MAX : (((uint64_t)1 << nb_bits) - 1) << bit;
+        if (is_set) {
+            bits[pos >> 6] |= mask;
+        }
+        else {
+            bits[pos >> 6] &= ~mask;
+        }
+        pos += nb_bits;
+        length -= nb_bits;
+    }
+}
+
+/* Number of consecutive octets received starting at position "pos", at most "length_max" */
+static size_t picoquic_reassembly_ring_run(const uint64_t* bits, size_t pos, size_t length_max)
+{
+    size_t length = 0;
+
+    while (length < length_max) {
+        size_t bit = (pos + length) & 63;
+        uint64_t word = bits[(pos + length) >> 6] >> bit;
+
+        if (word == (UINT64_MAX >> bit)) {
+            length += 64 - bit;
+        }
+        else {
+            while ((word & 1) != 0) {
+                length++;
+                word >>= 1;
+            }
+            break;
+        }
+    }
+
+    return (length > length_max) ? length_max : length;
+}
+
+/* Clear the bits of the octets consumed by the application, so the positions
+ * can be reused for the octets at the end of the window. */
+static void picoquic_reassembly_ring_advance(picoquic_reassembly_ring_t* ring, uint64_t consumed_offset)
+{
+    if (consumed_offset > ring->base_offset) {
+        uint64_t delta = consumed_offset - ring->base_offset;
+
+        if (delta >= ring->size) {
+            memset(ring->received, 0, ring->size / 8);
+        }
+        else {
+            size_t pos = (size_t)(ring->base_offset % ring->size);
+            size_t first = ring->size - pos;
+
+            if (first > delta) {
+                first = (size_t)delta;
+            }
+            picoquic_reassembly_ring_mark(ring->received, pos, first, 0);
+            picoquic_reassembly_ring_mark(ring->received, 0, (size_t)delta - first, 0);
+        }
+        ring->base_offset = consumed_offset;
+    }
+}
+
+/* Copy the received data in the ring. Returns the number of leading octets of
+ * the input that were either already consumed or copied in the ring. The
+ * octets beyond the window, if any, are left for the caller. */
+size_t picoquic_reassembly_ring_input(picoquic_stream_head_t* stream, uint64_t offset, const uint8_t* bytes, size_t length)
+{
+    picoquic_reassembly_ring_t* ring = stream->reassembly_ring;
+    uint64_t window_end = stream->consumed_offset + ring->size;
+    uint64_t start = (offset < stream->consumed_offset) ? stream->consumed_offset : offset;
+    uint64_t end = offset + length;
+    size_t handled = length;
+
+    if (end > window_end) {
+        end = window_end;
+        handled = (window_end > offset) ? (size_t)(window_end - offset) : 0;
+    }
+
+    picoquic_reassembly_ring_advance(ring, stream->consumed_offset);
+
+    if (end > start) {
+        size_t pos = (size_t)(start % ring->size);
+        size_t ring_length = (size_t)(end - start);
+        size_t first = ring->size - pos;
+        const uint8_t* data = bytes + (size_t)(start - offset);
+
+        if (first > ring_length) {
+            first = ring_length;
+        }
+        memcpy(ring->buffer + pos, data, first);
+        picoquic_reassembly_ring_mark(ring->received, pos, first, 1);
+        if (ring_length > first) {
+            memcpy(ring->buffer, data + first, ring_length - first);
+            picoquic_reassembly_ring_mark(ring->received, 0, ring_length - first, 1);
+        }
+    }
+
+    return handled;
+}
+
 static void picoquic_stream_data_chunk_callback(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
-    const uint8_t * bytes, size_t data_length)
+    const uint8_t * bytes, size_t data_length, picoquic_stream_data_node_t* data_node)
 {
     picoquic_call_back_event_t fin_now = picoquic_callback_stream_data;
     int call_back_needed = data_length > 0;
 
+    if (cnx->quic->rcv_window_max != 0 && data_length > 0) {
+        picoquic_rcv_autotune_update(cnx, &stream->rcv_autotune, stream->consumed_offset, stream->maxdata_local,
+            picoquic_get_quic_time(cnx->quic));
+    }
     stream->consumed_offset += data_length;
 
     if (stream->consumed_offset >= stream->fin_offset && stream->fin_received && !stream->fin_signalled) {
@@ -1062,42 +1227,439 @@ static void picoquic_stream_data_chunk_callback(picoquic_cnx_t* cnx, picoquic_st
         call_back_needed = 1;
     }
 
-    if (call_back_needed && !stream->stop_sending_requested && !stream->is_discarded &&
-        cnx->callback_fn(cnx, stream->stream_id, (uint8_t *)bytes, data_length, fin_now,
-        cnx->callback_ctx, stream->app_stream_ctx) != 0) {
-        picoquic_log_app_message(cnx, "Data callback (%d, l=%zu) on stream %" PRIu64 " returns error 0x%x",
-            fin_now, data_length, stream->stream_id, PICOQUIC_TRANSPORT_INTERNAL_ERROR);
-        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
+    if (call_back_needed && !stream->stop_sending_requested && !stream->is_discarded) {
+        int ret;
+        picoquic_cpu_mark_t cpu_mark;
+
+        cnx->delivered_data_node = (data_length > 0) ? data_node : NULL;
+        picoquic_cpu_mark(cnx->quic, &cpu_mark);
+        ret = cnx->callback_fn(cnx, stream->stream_id, (uint8_t*)bytes, data_length, fin_now,
+            cnx->callback_ctx, stream->app_stream_ctx);
+        picoquic_cpu_account_app(cnx, &cpu_mark);
+        cnx->delivered_data_node = NULL;
+        if (ret != 0) {
+            picoquic_log_app_message(cnx, "Data callback (%d, l=%zu) on stream %" PRIu64 " returns error 0x%x",
+                fin_now, data_length, stream->stream_id, PICOQUIC_TRANSPORT_INTERNAL_ERROR);
+            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
+        }
+    }
+}
+
+/* Compute the new stream flow control limit, or return 0 if no update is needed.
+ * Streams with a reassembly ring do not let the peer send beyond the ring
+ * window, and only update the limit once half of the ring is free.
+ * Streams under application flow control only count the data released
+ * by the application, see picoquic_stream_data_consumed. */
+uint64_t picoquic_stream_new_max_data(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    uint64_t new_max_data = 0;
+    uint64_t consumed_offset = stream->consumed_offset;
+
+    if (stream->is_app_flow_controlled && stream->app_consumed_offset < consumed_offset) {
+        consumed_offset = stream->app_consumed_offset;
+    }
+
+    if (stream->reassembly_ring != NULL) {
+        uint64_t window_end = consumed_offset + stream->reassembly_ring->size;
+
+        if (window_end >= stream->maxdata_local + stream->reassembly_ring->size / 2) {
+            new_max_data = window_end;
+        }
+    }
+    else if (cnx->quic->rcv_window_max != 0 && stream->rcv_autotune.window != 0) {
+        new_max_data = picoquic_rcv_autotune_new_limit(&stream->rcv_autotune, consumed_offset, stream->maxdata_local);
     }
+    else if (2 * consumed_offset > stream->maxdata_local) {
+        new_max_data = stream->maxdata_local + picoquic_cc_increased_window(cnx, stream->maxdata_local);
+    }
+
+    return new_max_data;
+}
+
+/* Deliver the contiguous data at the beginning of the ring window. There is
+ * one callback per contiguous run, or two if the run wraps around the end of the ring. */
+static void picoquic_reassembly_ring_callback(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    size_t length;
+
+    do {
+        picoquic_reassembly_ring_t* ring = stream->reassembly_ring;
+        size_t pos = (size_t)(stream->consumed_offset % ring->size);
+
+        picoquic_reassembly_ring_advance(ring, stream->consumed_offset);
+        length = picoquic_reassembly_ring_run(ring->received, pos, ring->size - pos);
+        if (length > 0) {
+            picoquic_stream_data_chunk_callback(cnx, stream, ring->buffer + pos, length, NULL);
+        }
+    } while (length > 0 && stream->reassembly_ring != NULL);
 }
 
 void picoquic_stream_data_callback(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
     picoquic_stream_data_node_t* data;
+    uint64_t consumed_before;
 
-    while ((data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree)) != NULL && data->offset <= stream->consumed_offset) {
-        size_t start = (size_t)(stream->consumed_offset - data->offset);
-        if (data->length >= start) {
-            size_t data_length = data->length - start;
-            picoquic_stream_data_chunk_callback(cnx, stream, data->bytes + start, data_length);
+    /* If the stream has a reassembly ring, the splay only holds data received
+     * beyond the ring window, so delivery alternates between both. */
+    do {
+        consumed_before = stream->consumed_offset;
+        if (stream->reassembly_ring != NULL) {
+            picoquic_reassembly_ring_callback(cnx, stream);
         }
-        picosplay_delete_hint(&stream->stream_data_tree, &data->stream_data_node);
-    }
+        while ((data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree)) != NULL && data->offset <= stream->consumed_offset) {
+            size_t start = (size_t)(stream->consumed_offset - data->offset);
+            if (data->length >= start) {
+                size_t data_length = data->length - start;
+                picoquic_stream_data_chunk_callback(cnx, stream, data->bytes + start, data_length, data);
+            }
+            picosplay_delete_hint(&stream->stream_data_tree, &data->stream_data_node);
+        }
+    } while (stream->reassembly_ring != NULL && stream->consumed_offset > consumed_before);
 
     /* handle the case where the fin frame does not carry any data */
-    picoquic_stream_data_chunk_callback(cnx, stream, NULL, 0);
+    picoquic_stream_data_chunk_callback(cnx, stream, NULL, 0, NULL);
+}
+
+/* Coalesced delivery of received data, see picoquic_set_stream_data_batch_delivery.
+ * Within a receive batch, streams with new data and received datagrams are
+ * queued, and delivered by picoquic_delivery_batch_flush when the batch ends.
+ */
+static picoquic_delivery_batch_t* picoquic_delivery_batch_get(picoquic_cnx_t* cnx)
+{
+    if (cnx->delivery_batch == NULL) {
+        cnx->delivery_batch = (picoquic_delivery_batch_t*)malloc(sizeof(picoquic_delivery_batch_t));
+        if (cnx->delivery_batch != NULL) {
+            memset(cnx->delivery_batch, 0, sizeof(picoquic_delivery_batch_t));
+        }
+    }
+    return cnx->delivery_batch;
+}
+
+static void picoquic_delivery_batch_queue_cnx(picoquic_cnx_t* cnx)
+{
+    if (!cnx->is_delivery_batch_queued) {
+        cnx->delivery_batch_next = cnx->quic->delivery_batch_first;
+        cnx->quic->delivery_batch_first = cnx;
+        cnx->is_delivery_batch_queued = 1;
+    }
+}
+
+static int picoquic_delivery_batch_is_stream_eligible(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    return cnx->is_stream_data_batch_enabled && cnx->quic->is_receive_batch_open &&
+        stream->reassembly_ring == NULL && stream->direct_receive_fn == NULL;
+}
+
+static void picoquic_delivery_batch_queue_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (!stream->is_delivery_queued) {
+        stream->next_delivery_stream = NULL;
+        if (cnx->last_delivery_stream == NULL) {
+            cnx->first_delivery_stream = stream;
+        }
+        else {
+            cnx->last_delivery_stream->next_delivery_stream = stream;
+        }
+        cnx->last_delivery_stream = stream;
+        stream->is_delivery_queued = 1;
+    }
+    picoquic_delivery_batch_queue_cnx(cnx);
+}
+
+void picoquic_delivery_batch_forget_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->is_delivery_queued) {
+        picoquic_stream_head_t** pprevious = &cnx->first_delivery_stream;
+        picoquic_stream_head_t* previous = NULL;
+
+        while (*pprevious != NULL && *pprevious != stream) {
+            previous = *pprevious;
+            pprevious = &(*pprevious)->next_delivery_stream;
+        }
+        if (*pprevious != NULL) {
+            *pprevious = stream->next_delivery_stream;
+            if (cnx->last_delivery_stream == stream) {
+                cnx->last_delivery_stream = previous;
+            }
+        }
+        stream->next_delivery_stream = NULL;
+        stream->is_delivery_queued = 0;
+    }
+}
+
+/* Copy a received datagram in the batch. Returns -1 if memory is not
+ * available, in which case the datagram is delivered immediately. */
+static int picoquic_datagram_batch_add(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length)
+{
+    int ret = 0;
+    picoquic_delivery_batch_t* batch = picoquic_delivery_batch_get(cnx);
+
+    if (batch == NULL) {
+        ret = -1;
+    }
+    else {
+        if (batch->datagram_bytes_used + length > batch->datagram_bytes_allocated) {
+            size_t new_size = 2 * batch->datagram_bytes_allocated;
+            uint8_t* new_bytes;
+
+            if (new_size < batch->datagram_bytes_used + length) {
+                new_size = batch->datagram_bytes_used + length + PICOQUIC_MAX_PACKET_SIZE;
+            }
+            if ((new_bytes = (uint8_t*)realloc(batch->datagram_bytes, new_size)) == NULL) {
+                ret = -1;
+            }
+            else {
+                batch->datagram_bytes = new_bytes;
+                batch->datagram_bytes_allocated = new_size;
+            }
+        }
+        if (ret == 0 && batch->nb_datagrams >= batch->datagram_lengths_allocated) {
+            size_t new_nb = (batch->datagram_lengths_allocated == 0) ? 16 : 2 * batch->datagram_lengths_allocated;
+            size_t* new_lengths = (size_t*)realloc(batch->datagram_lengths, new_nb * sizeof(size_t));
+
+            if (new_lengths == NULL) {
+                ret = -1;
+            }
+            else {
+                batch->datagram_lengths = new_lengths;
+                batch->datagram_lengths_allocated = new_nb;
+            }
+        }
+        if (ret == 0) {
+            if (length > 0) {
+                memcpy(batch->datagram_bytes + batch->datagram_bytes_used, bytes, length);
+            }
+            batch->datagram_bytes_used += length;
+            batch->datagram_lengths[batch->nb_datagrams++] = length;
+            picoquic_delivery_batch_queue_cnx(cnx);
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_delivery_batch_reserve_iov(picoquic_delivery_batch_t* batch, size_t nb_iov)
+{
+    int ret = 0;
+
+    if (nb_iov > batch->iov_allocated) {
+        size_t new_nb = (batch->iov_allocated == 0) ? 16 : 2 * batch->iov_allocated;
+        picoquic_iovec_t* new_iov;
+
+        if (new_nb < nb_iov) {
+            new_nb = nb_iov;
+        }
+        if ((new_iov = (picoquic_iovec_t*)realloc(batch->iov, new_nb * sizeof(picoquic_iovec_t))) == NULL) {
+            ret = -1;
+        }
+        else {
+            batch->iov = new_iov;
+            batch->iov_allocated = new_nb;
+        }
+    }
+
+    return ret;
+}
+
+static void picoquic_datagram_batch_deliver(picoquic_cnx_t* cnx, picoquic_delivery_batch_t* batch)
+{
+    if (batch->nb_datagrams > 0) {
+        if (picoquic_delivery_batch_reserve_iov(batch, batch->nb_datagrams) != 0) {
+            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, picoquic_frame_type_datagram);
+        }
+        else if (cnx->callback_fn != NULL) {
+            size_t offset = 0;
+            picoquic_cpu_mark_t cpu_mark;
+            int app_ret;
+
+            for (size_t i = 0; i < batch->nb_datagrams; i++) {
+                batch->iov[i].base = batch->datagram_bytes + offset;
+                batch->iov[i].len = batch->datagram_lengths[i];
+                offset += batch->datagram_lengths[i];
+            }
+            picoquic_cpu_mark(cnx->quic, &cpu_mark);
+            app_ret = cnx->callback_fn(cnx, 0, (uint8_t*)batch->iov, batch->nb_datagrams,
+                picoquic_callback_datagram_batch, cnx->callback_ctx, NULL);
+            picoquic_cpu_account_app(cnx, &cpu_mark);
+            if (app_ret != 0) {
+                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, picoquic_frame_type_datagram);
+            }
+        }
+        batch->nb_datagrams = 0;
+        batch->datagram_bytes_used = 0;
+    }
+}
+
+/* Deliver all the contiguous data available at the consumed offset in a single callback */
+static void picoquic_stream_data_batch_deliver(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
+    picoquic_delivery_batch_t* batch)
+{
+    picoquic_stream_data_node_t* data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree);
+    picoquic_stream_data_batch_t batch_arg;
+    uint64_t next_offset = stream->consumed_offset;
+    size_t total_length = 0;
+    int is_fin = 0;
+
+    batch_arg.nb_iov = 0;
+    while (data != NULL && data->offset <= next_offset) {
+        if (data->offset + data->length > next_offset) {
+            size_t start = (size_t)(next_offset - data->offset);
+
+            if (picoquic_delivery_batch_reserve_iov(batch, batch_arg.nb_iov + 1) != 0) {
+                /* Deliver what fits, the rest waits for the next batch */
+                break;
+            }
+            batch->iov[batch_arg.nb_iov].base = data->bytes + start;
+            batch->iov[batch_arg.nb_iov].len = data->length - start;
+            batch_arg.nb_iov++;
+            total_length += data->length - start;
+            next_offset = data->offset + data->length;
+        }
+        data = (picoquic_stream_data_node_t*)picosplay_next(&data->stream_data_node);
+    }
+    is_fin = stream->fin_received && !stream->fin_signalled && next_offset >= stream->fin_offset;
+
+    if (batch_arg.nb_iov > 0 || is_fin) {
+        if (cnx->quic->rcv_window_max != 0 && total_length > 0) {
+            picoquic_rcv_autotune_update(cnx, &stream->rcv_autotune, stream->consumed_offset, stream->maxdata_local,
+                picoquic_get_quic_time(cnx->quic));
+        }
+        stream->consumed_offset = next_offset;
+        if (is_fin) {
+            stream->fin_signalled = 1;
+        }
+        if (!stream->stop_sending_requested && !stream->is_discarded) {
+            picoquic_cpu_mark_t cpu_mark;
+            int ret;
+
+            batch_arg.iov = batch->iov;
+            batch_arg.is_fin = is_fin;
+            picoquic_cpu_mark(cnx->quic, &cpu_mark);
+            ret = cnx->callback_fn(cnx, stream->stream_id, (uint8_t*)&batch_arg, total_length,
+                picoquic_callback_stream_data_batch, cnx->callback_ctx, stream->app_stream_ctx);
+            picoquic_cpu_account_app(cnx, &cpu_mark);
+            if (ret != 0) {
+                picoquic_log_app_message(cnx, "Data batch callback (l=%zu) on stream %" PRIu64 " returns error 0x%x",
+                    total_length, stream->stream_id, PICOQUIC_TRANSPORT_INTERNAL_ERROR);
+                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
+            }
+        }
+        /* The segments are only released after the callback */
+        while ((data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree)) != NULL &&
+            data->offset + data->length <= stream->consumed_offset) {
+            picosplay_delete_hint(&stream->stream_data_tree, &data->stream_data_node);
+        }
+    }
+
+    if (stream->fin_signalled) {
+        (void)picoquic_delete_stream_if_closed(cnx, stream);
+    }
+    else if (!stream->fin_received && !stream->reset_received && picoquic_stream_new_max_data(cnx, stream) != 0) {
+        cnx->max_stream_data_needed = 1;
+    }
+}
+
+void picoquic_delivery_batch_flush(picoquic_cnx_t* cnx)
+{
+    picoquic_delivery_batch_t* batch = cnx->delivery_batch;
+    picoquic_stream_head_t* stream;
+
+    if (batch != NULL) {
+        picoquic_datagram_batch_deliver(cnx, batch);
+
+        while ((stream = cnx->first_delivery_stream) != NULL) {
+            cnx->first_delivery_stream = stream->next_delivery_stream;
+            if (cnx->first_delivery_stream == NULL) {
+                cnx->last_delivery_stream = NULL;
+            }
+            stream->next_delivery_stream = NULL;
+            stream->is_delivery_queued = 0;
+            if (cnx->callback_fn != NULL) {
+                picoquic_stream_data_batch_deliver(cnx, stream, batch);
+            }
+        }
+    }
+}
+
+/* Remove the connection from the list of pending deliveries, dropping the
+ * pending data. Used when the connection is deleted. */
+void picoquic_delivery_batch_forget_cnx(picoquic_cnx_t* cnx)
+{
+    picoquic_stream_head_t* stream;
+
+    if (cnx->is_delivery_batch_queued) {
+        picoquic_cnx_t** pprevious = &cnx->quic->delivery_batch_first;
+
+        while (*pprevious != NULL && *pprevious != cnx) {
+            pprevious = &(*pprevious)->delivery_batch_next;
+        }
+        if (*pprevious != NULL) {
+            *pprevious = cnx->delivery_batch_next;
+        }
+        cnx->delivery_batch_next = NULL;
+        cnx->is_delivery_batch_queued = 0;
+    }
+    while ((stream = cnx->first_delivery_stream) != NULL) {
+        cnx->first_delivery_stream = stream->next_delivery_stream;
+        stream->next_delivery_stream = NULL;
+        stream->is_delivery_queued = 0;
+    }
+    cnx->last_delivery_stream = NULL;
+    if (cnx->delivery_batch != NULL) {
+        free(cnx->delivery_batch->iov);
+        free(cnx->delivery_batch->datagram_bytes);
+        free(cnx->delivery_batch->datagram_lengths);
+        free(cnx->delivery_batch);
+        cnx->delivery_batch = NULL;
+    }
+}
+
+void picoquic_set_stream_data_batch_delivery(picoquic_cnx_t* cnx, int enable)
+{
+    cnx->is_stream_data_batch_enabled = (enable) ? 1 : 0;
+}
+
+void picoquic_set_datagram_batch_delivery(picoquic_cnx_t* cnx, int enable)
+{
+    cnx->is_datagram_batch_enabled = (enable) ? 1 : 0;
 }
 
-static int add_chunk_node(picoquic_quic_t * quic, picosplay_tree_t* tree, uint64_t offset,
+static int add_chunk_node(picoquic_quic_t * quic, picoquic_cnx_t* cnx, picosplay_tree_t* tree, uint64_t offset,
     size_t length, int is_last_frame, 
     const uint8_t* bytes, int* chunk_added, picoquic_stream_data_node_t * received_data)
 {
     int ret = 0;
-
+    int is_in_packet = picoquic_is_in_data_node(received_data, bytes, length);
     picoquic_stream_data_node_t* node = received_data;
     
-    if (received_data == NULL || received_data->bytes != NULL || !is_last_frame) {
-        node = picoquic_stream_data_node_alloc(quic);
+    if (is_in_packet && received_data->bytes == NULL && is_last_frame) {
+        /* The pointer "bytes" is inside the received data packet. */
+        node->bytes = bytes;
+        node->offset = offset;
+        node->length = length;
+    }
+    else if (is_in_packet && length > PICOQUIC_SMALL_PACKET_SIZE) {
+        /* Large chunk, not the last in the packet: instead of copying, queue
+         * a small node that points into the packet, and hold a reference
+         * to the packet buffer until that node is deleted. */
+        node = picoquic_stream_data_node_alloc_ex(quic, 0);
+        if (node == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            node->bytes = bytes;
+            node->offset = offset;
+            node->length = length;
+            node->buffer_node = received_data;
+            received_data->nb_refs++;
+            if (cnx != NULL && received_data->cnx == NULL) {
+                picoquic_memory_charge(cnx, picoquic_memory_stream_receive, PICOQUIC_DATA_NODE_ALLOC_SIZE(received_data->data_max));
+                received_data->cnx = cnx;
+            }
+        }
+    }
+    else {
+        node = picoquic_stream_data_node_alloc_ex(quic, length);
         if (node == NULL) {
             ret = PICOQUIC_ERROR_MEMORY;
         }
@@ -1110,14 +1672,12 @@ static int add_chunk_node(picoquic_quic_t * quic, picosplay_tree_t* tree, uint64
             node->length = length;
         }
     }
-    else {
-        /* The pointer "bytes" is inside the received data packet. */
-        node->bytes = bytes;
-        node->offset = offset;
-        node->length = length;
-    }
 
     if (node != NULL){
+        if (cnx != NULL && node->cnx == NULL) {
+            picoquic_memory_charge(cnx, picoquic_memory_stream_receive, PICOQUIC_DATA_NODE_ALLOC_SIZE(node->data_max));
+            node->cnx = cnx;
+        }
         picosplay_insert(tree, node);
         *chunk_added = 1;
     }
@@ -1126,7 +1686,7 @@ static int add_chunk_node(picoquic_quic_t * quic, picosplay_tree_t* tree, uint64
 }
 
 /* Common code to data stream and crypto hs stream */
-int picoquic_queue_network_input(picoquic_quic_t * quic, picosplay_tree_t* tree, uint64_t consumed_offset,
+int picoquic_queue_network_input(picoquic_quic_t * quic, picoquic_cnx_t* cnx, picosplay_tree_t* tree, uint64_t consumed_offset,
     uint64_t frame_data_offset, const uint8_t* bytes, size_t length, int is_last_frame, picoquic_stream_data_node_t* received_data, int* new_data_available)
 {
     const uint64_t input_begin = frame_data_offset;
@@ -1143,7 +1703,7 @@ int picoquic_queue_network_input(picoquic_quic_t * quic, picosplay_tree_t* tree,
     if (frame_data_offset < input_end) {
 
         picoquic_stream_data_node_t target;
-        memset(&target, 0, sizeof(picoquic_stream_data_node_t));
+        memset(&target, 0, offsetof(picoquic_stream_data_node_t, data));
         target.offset = frame_data_offset;
 
         picoquic_stream_data_node_t* prev = (picoquic_stream_data_node_t*)picosplay_find_previous(tree, &target);
@@ -1167,7 +1727,7 @@ int picoquic_queue_network_input(picoquic_quic_t * quic, picosplay_tree_t* tree,
 
             if (chunk_len > 0) {
                 /* There is a gap between previous and next frame, and it will be at least partially filled */
-                ret = add_chunk_node(quic, tree, chunk_ofs, (size_t)chunk_len, is_last_frame,
+                ret = add_chunk_node(quic, cnx, tree, chunk_ofs, (size_t)chunk_len, is_last_frame,
                     bytes + frame_data_offset - input_begin, new_data_available, received_data);
             }
 
@@ -1179,7 +1739,7 @@ int picoquic_queue_network_input(picoquic_quic_t * quic, picosplay_tree_t* tree,
         if (ret == 0 && frame_data_offset < input_end) {
             const uint64_t chunk_ofs = frame_data_offset;
             const uint64_t chunk_len = input_end - frame_data_offset;
-            ret = add_chunk_node(quic, tree, chunk_ofs, (size_t)chunk_len, is_last_frame,
+            ret = add_chunk_node(quic, cnx, tree, chunk_ofs, (size_t)chunk_len, is_last_frame,
                 bytes + frame_data_offset - input_begin, new_data_available, received_data);
         }
     }
@@ -1224,13 +1784,15 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
     }
 
     /* If the application provided a direct receive callback, it wil receive the data as they
-     * arrive. If not, the data segments are organized in a splay and passed to the
-     * application in strict order.
+     * arrive. If not, the data segments are organized in a splay, or in the reassembly
+     * ring if the stream has one, and passed to the application in strict order.
      */
 
     if (ret == 0) {
         if (stream->direct_receive_fn != NULL) {
+            cnx->delivered_data_node = picoquic_is_in_data_node(received_data, bytes, length) ? received_data : NULL;
             ret = stream->direct_receive_fn(cnx, stream_id, fin, bytes, offset, length, stream->direct_receive_ctx);
+            cnx->delivered_data_node = NULL;
             if (ret == PICOQUIC_STREAM_RECEIVE_COMPLETE && stream->fin_received) {
                 stream->fin_signalled = 1;
                 ret = 0;
@@ -1239,14 +1801,16 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
                 uint64_t err = (ret >= PICOQUIC_ERROR_CLASS) ? PICOQUIC_TRANSPORT_INTERNAL_ERROR : (uint64_t)ret;
                 ret = picoquic_connection_error(cnx, err, 0);
             }
-        } else if (stream->consumed_offset >= offset &&  cnx->callback_fn != NULL){
+        } else if (stream->consumed_offset >= offset &&  cnx->callback_fn != NULL &&
+            !picoquic_delivery_batch_is_stream_eligible(cnx, stream)){
             if (new_fin_offset >= stream->consumed_offset) {
                 /* Arrival of in sequence bytes */
                 uint64_t delivered_index = stream->consumed_offset - offset;
                 uint64_t data_length = length - delivered_index;
 
                 /* Ugly cast, but the callback requires a non-const pointer */
-                picoquic_stream_data_chunk_callback(cnx, stream, (uint8_t *)bytes + delivered_index, (size_t)data_length);
+                picoquic_stream_data_chunk_callback(cnx, stream, (uint8_t *)bytes + delivered_index, (size_t)data_length,
+                    picoquic_is_in_data_node(received_data, bytes, length) ? received_data : NULL);
                 /* Adjust the tree if needed */
                 picoquic_stream_data_callback(cnx, stream);
             }
@@ -1256,8 +1820,19 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
         } else {
             int new_data_available = 0;
 
-            ret = picoquic_queue_network_input(cnx->quic, &stream->stream_data_tree, stream->consumed_offset,
-                offset, bytes, length, is_last_frame, received_data, &new_data_available);
+            if (stream->reassembly_ring != NULL) {
+                /* Only the data beyond the ring window, if any, goes to the splay */
+                size_t handled = picoquic_reassembly_ring_input(stream, offset, bytes, length);
+
+                new_data_available = handled > 0;
+                offset += handled;
+                bytes += handled;
+                length -= handled;
+            }
+            if (length > 0) {
+                ret = picoquic_queue_network_input(cnx->quic, cnx, &stream->stream_data_tree, stream->consumed_offset,
+                    offset, bytes, length, is_last_frame, received_data, &new_data_available);
+            }
             if (ret != 0) {
                 ret = picoquic_connection_error(cnx, (int64_t)ret, 0);
             }
@@ -1267,9 +1842,15 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
             }
 
             if (ret == 0 && should_notify != 0 && cnx->callback_fn != NULL) {
-                /* check how much data there is to send */
-                picoquic_stream_data_callback(cnx, stream);
-            }
+                if (picoquic_delivery_batch_is_stream_eligible(cnx, stream)) {
+                    /* Delivered with the other data of the batch */
+                    picoquic_delivery_batch_queue_stream(cnx, stream);
+                }
+                else {
+                    /* check how much data there is to send */
+                    picoquic_stream_data_callback(cnx, stream);
+                }
+            }
         }
     }
 
@@ -1285,7 +1866,7 @@ static int picoquic_stream_network_input(picoquic_cnx_t* cnx, uint64_t stream_id
 
         if (!is_deleted) {
             if (!stream->fin_signalled) {
-                if (!stream->fin_received && !stream->reset_received && 2 * stream->consumed_offset > stream->maxdata_local) {
+                if (!stream->fin_received && !stream->reset_received && picoquic_stream_new_max_data(cnx, stream) != 0) {
                     cnx->max_stream_data_needed = 1;
                 }
             }
@@ -1353,11 +1934,6 @@ picoquic_stream_head_t* picoquic_find_ready_stream_path(picoquic_cnx_t* cnx, pic
         int has_data = 0;
         picoquic_stream_head_t* next_stream = stream->next_output_stream;
 
-        if (found_stream != NULL && stream->stream_priority > found_stream->stream_priority) {
-            /* All the streams at that priority level have been examined,
-             * the current selection is validated */
-            break;
-        }
         has_data = (cnx->maxdata_remote > cnx->data_sent && stream->sent_offset < stream->maxdata_remote && (stream->is_active ||
                 (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset) ||
                 (stream->fin_requested && !stream->fin_sent)));
@@ -1380,16 +1956,11 @@ picoquic_stream_head_t* picoquic_find_ready_stream_path(picoquic_cnx_t* cnx, pic
                 }
             }
             if (has_data) {
-                /* Something can be sent */
-                if ((stream->stream_priority & 1) != 0) {
-                    /* This priority level requests FIFO processing, so we return the first available stream */
-                    found_stream = stream;
-                    break;
-                }
-                else if (found_stream == NULL || stream->last_time_data_sent < found_stream->last_time_data_sent) {
-                    /* Select this stream, but need to check if another stream should go before in round robin order */
-                    found_stream = stream;
-                }
+                /* Something can be sent. Streams are listed by priority, then in FIFO or
+                 * round robin order within each priority level, so the first available
+                 * stream is the one to serve. */
+                found_stream = stream;
+                break;
             }
         }
         else if (((stream->fin_requested && stream->fin_sent) || (stream->reset_requested && stream->reset_sent)) && (!stream->stop_sending_requested || stream->stop_sending_sent)) {
@@ -1615,6 +2186,49 @@ uint8_t* picoquic_provide_stream_data_buffer(void* context, size_t length, int i
     return buffer;
 }
 
+size_t picoquic_provide_stream_data_iov(void* context, const picoquic_iovec_t* iov, size_t nb_iov,
+    int is_fin, int is_still_active)
+{
+    picoquic_stream_data_buffer_argument_t* data_ctx = (picoquic_stream_data_buffer_argument_t*)context;
+    size_t length = SIZE_MAX;
+
+    if (data_ctx != NULL) {
+        size_t total = 0;
+        uint8_t* buffer;
+
+        for (size_t i = 0; i < nb_iov && total <= data_ctx->allowed_space; i++) {
+            total += (iov[i].len > data_ctx->allowed_space) ? data_ctx->allowed_space + 1 : iov[i].len;
+        }
+
+        if (total > data_ctx->allowed_space) {
+            /* Send what fits, the application will be called again for the rest */
+            length = data_ctx->allowed_space;
+            is_fin = 0;
+            is_still_active = 1;
+        }
+        else {
+            length = total;
+        }
+
+        if ((buffer = picoquic_provide_stream_data_buffer(context, length, is_fin, is_still_active)) == NULL) {
+            length = SIZE_MAX;
+        }
+        else {
+            size_t copied = 0;
+
+            for (size_t i = 0; i < nb_iov && copied < length; i++) {
+                size_t seg_length = (iov[i].len > length - copied) ? length - copied : iov[i].len;
+                if (seg_length > 0) {
+                    memcpy(buffer + copied, iov[i].base, seg_length);
+                    copied += seg_length;
+                }
+            }
+        }
+    }
+
+    return length;
+}
+
 uint8_t* picoquic_format_stream_frame_header(uint8_t* bytes, uint8_t* bytes_max, uint64_t stream_id, uint64_t offset)
 {
     uint8_t* bytes0 = bytes;
@@ -1629,6 +2243,52 @@ uint8_t* picoquic_format_stream_frame_header(uint8_t* bytes, uint8_t* bytes_max,
     return bytes;
 }
 
+/* Delivery deadlines.
+ * Data is expired if the stream deadline has passed, or if it overlaps a
+ * range whose deadline has passed. Ranges that are fully acknowledged are
+ * removed from the head of the list.
+ */
+int picoquic_stream_data_is_expired(picoquic_stream_head_t* stream, uint64_t offset, uint64_t length, uint64_t current_time)
+{
+    int is_expired = 0;
+
+    if (stream->deadline != 0 && stream->deadline <= current_time) {
+        is_expired = 1;
+    }
+    else {
+        picoquic_stream_deadline_t* range;
+
+        while ((range = stream->first_deadline) != NULL &&
+            picoquic_check_sack_list(&stream->sack_list, range->start_offset, range->end_offset - 1) != 0) {
+            stream->first_deadline = range->next_deadline;
+            if (stream->first_deadline == NULL) {
+                stream->last_deadline = NULL;
+            }
+            free(range);
+        }
+
+        while (range != NULL && range->start_offset < offset + length) {
+            if (range->end_offset > offset && range->deadline <= current_time) {
+                is_expired = 1;
+                break;
+            }
+            range = range->next_deadline;
+        }
+    }
+
+    return is_expired;
+}
+
+void picoquic_stream_deadline_expire(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (!stream->reset_requested) {
+        cnx->nb_streams_expired++;
+        picoquic_log_app_message(cnx, "Stream %" PRIu64 " data expired, reset with error 0x%" PRIx64,
+            stream->stream_id, stream->deadline_error);
+        (void)picoquic_reset_stream(cnx, stream->stream_id, stream->deadline_error);
+    }
+}
+
 uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
     uint8_t* bytes, uint8_t* bytes_max, int * more_data, int * is_pure_ack, int* is_still_active, int * ret)
 {
@@ -1655,6 +2315,14 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
         return picoquic_format_stop_sending_frame(stream, bytes, bytes_max, more_data, is_pure_ack);
     }
 
+    if ((stream->deadline != 0 || stream->first_deadline != NULL) &&
+        (stream->is_active || (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset)) &&
+        picoquic_stream_data_is_expired(stream, stream->sent_offset, 1, picoquic_get_quic_time(cnx->quic))) {
+        /* Do not send data that is already too late */
+        picoquic_stream_deadline_expire(cnx, stream);
+        return picoquic_format_stream_reset_frame(cnx, stream, bytes, bytes_max, more_data, is_pure_ack);
+    }
+
     if (!stream->is_active &&
         (stream->send_queue == NULL || stream->send_queue->length <= stream->send_queue->offset) &&
         (!stream->fin_requested || stream->fin_sent)) {
@@ -1689,6 +2357,8 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
             if (stream->is_active && stream->send_queue == NULL && !stream->fin_requested) {
                 /* The application requested active polling for this stream */
                 picoquic_stream_data_buffer_argument_t stream_data_context;
+                picoquic_cpu_mark_t cpu_mark;
+                int app_ret;
 
                 stream_data_context.bytes = bytes0;
                 stream_data_context.byte_index = bytes - bytes0;
@@ -1699,7 +2369,11 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
                 stream_data_context.is_still_active = 0;
                 stream_data_context.app_buffer = NULL;
 
-                if ((cnx->callback_fn)(cnx, stream->stream_id, (uint8_t*)&stream_data_context, allowed_space, picoquic_callback_prepare_to_send, cnx->callback_ctx, stream->app_stream_ctx) != 0) {
+                picoquic_cpu_mark(cnx->quic, &cpu_mark);
+                app_ret = (cnx->callback_fn)(cnx, stream->stream_id, (uint8_t*)&stream_data_context, allowed_space, picoquic_callback_prepare_to_send, cnx->callback_ctx, stream->app_stream_ctx);
+                picoquic_cpu_account_app(cnx, &cpu_mark);
+
+                if (app_ret != 0) {
                     /* something went wrong */
                     picoquic_log_app_message(cnx, "Prepare to send returns error 0x%x", PICOQUIC_TRANSPORT_INTERNAL_ERROR);
                     *ret = picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0,
@@ -1717,6 +2391,7 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
                     stream->sent_offset += stream_data_context.length;
                     stream->last_time_data_sent = picoquic_get_quic_time(cnx->quic);
                     cnx->data_sent += stream_data_context.length;
+                    picoquic_requeue_output_stream(cnx, stream);
 
                     if (stream_data_context.length > 0) {
                         if (stream_data_context.app_buffer == NULL ||
@@ -1777,14 +2452,23 @@ uint8_t * picoquic_format_stream_frame(picoquic_cnx_t* cnx, picoquic_stream_head
                     stream->send_queue->offset += length;
                     if (stream->send_queue->offset >= stream->send_queue->length) {
                         picoquic_stream_queue_node_t* next = stream->send_queue->next_stream_data;
-                        free(stream->send_queue->bytes);
-                        free(stream->send_queue);
+                        if (cnx->is_stream_repeat_from_queue || cnx->nb_stream_frames_stripped > 0) {
+                            /* Keep the data until acked, so losses can be repaired from the stream.
+                             * Once frames were stripped, this holds even if the policy is cleared. */
+                            picoquic_stream_retain_sent_node(stream, stream->send_queue,
+                                stream->sent_offset + length - stream->send_queue->length);
+                        }
+                        else {
+                            picoquic_stream_queue_node_free(cnx, stream->send_queue);
+                        }
                         stream->send_queue = next;
                     }
 
                     stream->sent_offset += length;
                     stream->last_time_data_sent = picoquic_get_quic_time(cnx->quic);
                     cnx->data_sent += length;
+                    picoquic_requeue_output_stream(cnx, stream);
+                    picoquic_send_backlog_remove(cnx, stream, length);
                 }
 
                 bytes = bytes0 + byte_index;
@@ -1832,7 +2516,7 @@ uint8_t* picoquic_format_available_stream_frames(picoquic_cnx_t* cnx, picoquic_p
 {
     uint8_t* bytes_previous = bytes_next;
     picoquic_stream_head_t* stream = picoquic_find_ready_stream_path(cnx,
-        (cnx->is_multipath_enabled)?path_x: NULL);
+        (PICOQUIC_CNX_IS_MULTIPATH(cnx))?path_x: NULL);
     int more_stream_data = 0;
 
     while (*ret == 0 && stream != NULL && stream->stream_priority <= current_priority && bytes_next < bytes_max) {
@@ -1841,7 +2525,7 @@ uint8_t* picoquic_format_available_stream_frames(picoquic_cnx_t* cnx, picoquic_p
 
         if (*ret == 0) {
             stream = picoquic_find_ready_stream_path(cnx,
-                (cnx->is_multipath_enabled)?path_x: NULL);
+                (PICOQUIC_CNX_IS_MULTIPATH(cnx))?path_x: NULL);
             if (stream != NULL && bytes_next + 17 >= bytes_max) {
                 more_stream_data = 1;
                 break;
@@ -1863,76 +2547,149 @@ uint8_t* picoquic_format_available_stream_frames(picoquic_cnx_t* cnx, picoquic_p
     return bytes_next;
 }
 
-/* Organize the queue of packets containing stream data as a splay.
-* TODO: replace cnx->data_repeat_last and cnx->data_repeat_first by
-* root of splay.
-* Replace packet->data_repeat_next and packet->data_repeat_previous
-* by leaf of splay.
+/* When packets containing stream data are deemed lost, they are
+ * chained in the "data repeat queue", ordered by stream priority,
+ * stream id and offset. The queue is a single list, organized in
+ * buckets of packets of the same priority. The first packet of each
+ * bucket points to the last one, so inserting a packet only requires
+ * skipping over the buckets of lower priority, and the next packet to
+ * repeat is always the first in the list. Within a bucket, the search
+ * starts from the last packet queued for the same stream, which is
+ * usually just before the new one since packets are declared lost in
+ * the order in which they were sent.
  */
-
- /* When packets containing stream data are deemed lost, they are
- * chained in the "steam data queue". The queue is managed as
- * a splay, ordered by stream priority, stream id and offset.
- */
-static picosplay_node_t*picoquic_queue_data_repeat_node_create(void* value)
+static int picoquic_data_repeat_is_before(picoquic_packet_t* packet, picoquic_packet_t* other)
 {
-    return &((picoquic_packet_t*)value)->queue_data_repeat_node;
+    int is_before;
+
+    if (packet->data_repeat_stream_id != other->data_repeat_stream_id) {
+        is_before = packet->data_repeat_stream_id < other->data_repeat_stream_id;
+    }
+    else if (packet->data_repeat_stream_offset != other->data_repeat_stream_offset) {
+        is_before = packet->data_repeat_stream_offset < other->data_repeat_stream_offset;
+    }
+    else {
+        /* largest length goes in front */
+        is_before = packet->data_repeat_stream_data_length > other->data_repeat_stream_data_length;
+    }
+
+    return is_before;
 }
 
-void* picoquic_queue_data_repeat_node_value(picosplay_node_t* node)
+static void picoquic_data_repeat_insert(picoquic_cnx_t* cnx, picoquic_packet_t* packet, picoquic_stream_head_t* stream)
 {
-    return (void*)((char*)node - offsetof(struct st_picoquic_packet_t, queue_data_repeat_node));
-}
+    picoquic_packet_t* head = cnx->data_repeat_first;
+    picoquic_packet_t* previous = NULL;
 
+    /* Skip the buckets of lower priority, lower means more urgent */
+    while (head != NULL && head->data_repeat_priority < packet->data_repeat_priority) {
+        previous = head->data_repeat_bucket_last;
+        head = previous->data_repeat_next;
+    }
 
-int64_t picoquic_queue_data_repeat_compare(void* l, void* r)
-{
-    picoquic_packet_t* lp = (picoquic_packet_t*)picoquic_queue_data_repeat_node_value(l);
-    picoquic_packet_t* rp = (picoquic_packet_t*)picoquic_queue_data_repeat_node_value(r);
-    int64_t ret = 0;
-    /* TODO: comparison function is wrong, because the "data_repeat_frame" value
-     * varies over time. Also, the result may not be unique.
-     */
+    if (head != NULL && head->data_repeat_priority == packet->data_repeat_priority) {
+        /* Find the last packet of the bucket that is not after the new one */
+        picoquic_packet_t* hint = (stream == NULL) ? NULL : stream->data_repeat_hint;
 
-    /* Lower means more urgent, goes in front */
-    if (lp->data_repeat_priority > rp->data_repeat_priority) {
-        ret = 1;
+        if (hint == NULL || hint->data_repeat_priority != packet->data_repeat_priority) {
+            hint = head->data_repeat_bucket_last;
+        }
+        previous = hint;
+        while (previous != NULL && picoquic_data_repeat_is_before(packet, previous)) {
+            previous = (previous == head) ? NULL : previous->data_repeat_previous;
+        }
+        if (previous == hint) {
+            while (previous != head->data_repeat_bucket_last &&
+                !picoquic_data_repeat_is_before(packet, previous->data_repeat_next)) {
+                previous = previous->data_repeat_next;
+            }
+        }
+
+        if (previous == NULL) {
+            /* The packet becomes the first of the bucket */
+            packet->data_repeat_bucket_last = head->data_repeat_bucket_last;
+            head->data_repeat_bucket_last = NULL;
+            previous = head->data_repeat_previous;
+        }
+        else if (previous == head->data_repeat_bucket_last) {
+            head->data_repeat_bucket_last = packet;
+        }
     }
-    else if (lp->data_repeat_priority < rp->data_repeat_priority) {
-        ret = -1;
+    else {
+        /* First packet of that priority, create a bucket after the previous one */
+        packet->data_repeat_bucket_last = packet;
+    }
+
+    packet->data_repeat_previous = previous;
+    packet->data_repeat_next = (previous == NULL) ? cnx->data_repeat_first : previous->data_repeat_next;
+    if (packet->data_repeat_next != NULL) {
+        packet->data_repeat_next->data_repeat_previous = packet;
+    }
+    if (previous == NULL) {
+        cnx->data_repeat_first = packet;
     }
     else {
-        ret = lp->data_repeat_stream_id - rp->data_repeat_stream_id;
-        if (ret == 0) {
-            ret = lp->data_repeat_stream_offset - rp->data_repeat_stream_offset;
-            if (ret == 0) {
-                /* largest length goes in front */
-                ret = rp->data_repeat_stream_data_length - lp->data_repeat_stream_data_length;
-            }
-        }
+        previous->data_repeat_next = packet;
     }
 
-    return ret;
+    if (stream != NULL) {
+        if (stream->data_repeat_hint != NULL) {
+            stream->data_repeat_hint->is_data_repeat_hint = 0;
+        }
+        stream->data_repeat_hint = packet;
+        packet->is_data_repeat_hint = 1;
+    }
 }
 
-void picoquic_queue_data_repeat_delete(void* tree, picosplay_node_t* node)
+static void picoquic_data_repeat_remove(picoquic_cnx_t* cnx, picoquic_packet_t* packet)
 {
-    /* Packets can be queued simultaneously for data repeat and 
-    * for detection of spurious losses, so should only be recycled
-    * when removed from both queues */
-    picoquic_packet_t* packet = (picoquic_packet_t*)picoquic_queue_data_repeat_node_value(node);
-    picoquic_cnx_t * cnx = (picoquic_cnx_t *)((void *)((char*)tree - offsetof(struct st_picoquic_cnx_t, queue_data_repeat_tree)));
+    picoquic_packet_t* previous = packet->data_repeat_previous;
+    picoquic_packet_t* next = packet->data_repeat_next;
+    int is_first = (previous == NULL || previous->data_repeat_priority != packet->data_repeat_priority);
+    int is_last = (next == NULL || next->data_repeat_priority != packet->data_repeat_priority);
 
-    packet->is_queued_for_data_repeat = 0;
-    if (!packet->is_queued_for_spurious_detection) {
-        picoquic_recycle_packet(cnx->quic, packet);
+    if (packet->is_data_repeat_hint) {
+        /* The stream may have been deleted since the packet was queued */
+        picoquic_stream_head_t* stream = picoquic_find_stream(cnx, packet->data_repeat_stream_id);
+
+        if (stream != NULL && stream->data_repeat_hint == packet) {
+            stream->data_repeat_hint = NULL;
+            if (!is_first && previous->data_repeat_stream_id == packet->data_repeat_stream_id) {
+                stream->data_repeat_hint = previous;
+                previous->is_data_repeat_hint = 1;
+            }
+        }
+        packet->is_data_repeat_hint = 0;
+    }
+
+    if (is_first) {
+        if (!is_last) {
+            next->data_repeat_bucket_last = packet->data_repeat_bucket_last;
+        }
+    }
+    else if (is_last) {
+        picoquic_packet_t* head = previous;
+
+        while (head->data_repeat_previous != NULL &&
+            head->data_repeat_previous->data_repeat_priority == packet->data_repeat_priority) {
+            head = head->data_repeat_previous;
+        }
+        head->data_repeat_bucket_last = previous;
     }
-}
 
-void picoquic_queue_data_repeat_init(picoquic_cnx_t* cnx) {
-    picosplay_init_tree(&cnx->queue_data_repeat_tree, picoquic_queue_data_repeat_compare,
-        picoquic_queue_data_repeat_node_create, picoquic_queue_data_repeat_delete, picoquic_queue_data_repeat_node_value);
-} 
+    if (previous == NULL) {
+        cnx->data_repeat_first = next;
+    }
+    else {
+        previous->data_repeat_next = next;
+    }
+    if (next != NULL) {
+        next->data_repeat_previous = previous;
+    }
+    packet->data_repeat_next = NULL;
+    packet->data_repeat_previous = NULL;
+    packet->data_repeat_bucket_last = NULL;
+}
 
 /* Handling of queue of packets containing data frames that 
  * should be resent, unless somehow acknowledged before that.
@@ -1941,12 +2698,25 @@ void picoquic_queue_data_repeat_init(picoquic_cnx_t* cnx) {
 void picoquic_dequeue_data_repeat_packet(
     picoquic_cnx_t* cnx, picoquic_packet_t* packet)
 {
-    picosplay_delete_hint(&cnx->queue_data_repeat_tree, &packet->queue_data_repeat_node);
+    if (packet->is_queued_for_data_repeat) {
+        picoquic_data_repeat_remove(cnx, packet);
+        packet->is_queued_for_data_repeat = 0;
+    }
+    /* Packets can be queued simultaneously for data repeat and 
+    * for detection of spurious losses, so should only be recycled
+    * when removed from both queues */
+    if (!packet->is_queued_for_spurious_detection) {
+        picoquic_recycle_queued_packet(cnx, packet);
+    }
 }
 
-int picoquic_queue_data_repeat_adjust(picoquic_cnx_t* cnx, picoquic_packet_t* packet)
+/* Position the packet on its next stream data frame, and set the
+ * priority, stream and offset keys used in the queue. Also returns
+ * the stream context, if it still exists. */
+static int picoquic_queue_data_repeat_adjust(picoquic_cnx_t* cnx, picoquic_packet_t* packet, picoquic_stream_head_t** p_stream)
 {
     int ret = 0;
+    *p_stream = NULL;
     while (packet->data_repeat_frame < packet->length) {
         uint8_t* data_byte = packet->bytes + packet->data_repeat_frame;
         if (*data_byte >= picoquic_frame_type_stream_range_min && *data_byte <= picoquic_frame_type_stream_range_max) {
@@ -1971,6 +2741,7 @@ int picoquic_queue_data_repeat_adjust(picoquic_cnx_t* cnx, picoquic_packet_t* pa
                 else {
                     packet->data_repeat_priority = stream->stream_priority;
                 }
+                *p_stream = stream;
             }
             else {
                 /* Malformed packet, internal error */
@@ -1999,13 +2770,14 @@ void picoquic_queue_data_repeat_packet(
     picoquic_cnx_t* cnx, picoquic_packet_t* packet)
 {
     if (!packet->is_queued_for_data_repeat) {
+        picoquic_stream_head_t* stream = NULL;
         /* The stream frame, stream ID, priority are reset in the packet
          * header by the call to picoquic_queue_data_repeat_adjust */
         packet->data_repeat_frame = packet->offset;
         packet->data_repeat_index = packet->offset;
-        if (picoquic_queue_data_repeat_adjust(cnx, packet) == 0 &&
+        if (picoquic_queue_data_repeat_adjust(cnx, packet, &stream) == 0 &&
             packet->data_repeat_frame < packet->length) {
-            picosplay_insert(&cnx->queue_data_repeat_tree, packet);
+            picoquic_data_repeat_insert(cnx, packet, stream);
             packet->is_queued_for_data_repeat = 1;
         }
     }
@@ -2013,9 +2785,7 @@ void picoquic_queue_data_repeat_packet(
 
 picoquic_packet_t* picoquic_first_data_repeat_packet(picoquic_cnx_t* cnx)
 {
-    picosplay_node_t * first_node = picosplay_first(&cnx->queue_data_repeat_tree);
-    picoquic_packet_t* first_packet = (first_node == NULL) ? NULL : picoquic_queue_data_repeat_node_value(first_node);
-    return first_packet;
+    return cnx->data_repeat_first;
 }
 
 /* Copy stream frame from packet to specified buffer, and update the
@@ -2072,6 +2842,12 @@ uint8_t* picoquic_copy_stream_frame_for_retransmit(
                 /* That frame is not needed anymore */
                 is_needed = 0;
             }
+            else if ((stream->deadline != 0 || stream->first_deadline != NULL) &&
+                picoquic_stream_data_is_expired(stream, offset, data_available, picoquic_get_quic_time(cnx->quic))) {
+                /* Too late to repeat that frame, reset the stream instead */
+                picoquic_stream_deadline_expire(cnx, stream);
+                is_needed = 0;
+            }
         }
         if (is_needed) {
             /* Need to check how much can be encoded in the packet:
@@ -2144,7 +2920,7 @@ uint8_t* picoquic_copy_stream_frame_for_retransmit(
 * 1- Copy the bytes from the stream frame.
 * 2- If this does not exhaust the frame, reset the "index", return.
 * 3- If this does exhaust the frame:
-*    - Remove the packet from the splay, because the order will change
+*    - Remove the packet from the queue, because the order will change
 *    - Try to adjust the packet.
 *    - If there is a second stream frame, re-insert the packet,
 *      if not, recycle it, exit the per packet logic.
@@ -2173,28 +2949,30 @@ uint8_t* picoquic_copy_single_stream_frame_for_retransmit(picoquic_cnx_t* cnx, p
             }
         }
     }
-    /* Adjust to the next stream data boundary */
-    if (packet->data_repeat_frame < packet->length &&
-        picoquic_queue_data_repeat_adjust(cnx, packet) != 0) {
-        /* signal an error */
-        bytes_next = NULL;
-    }
-    /* Check whether the packet is completely processed, and can be dequeued */
-    if (packet->data_repeat_frame >= packet->length) {
-        /* Nothing left in this pasket. It can be safely dequeued */
-        picoquic_dequeue_data_repeat_packet(cnx, packet);
-        *packet_dequeued = 1;
-    }
-    else if (packet->data_repeat_frame > last_frame) {
-        /* There is another stream frame after this one.  Dequeue with
-        * caution, then requeue */
-        int was_queued = packet->is_queued_for_spurious_detection;
-        packet->is_queued_for_spurious_detection = 1;
-        picosplay_delete_hint(&cnx->queue_data_repeat_tree, &packet->queue_data_repeat_node);
-        packet->is_queued_for_spurious_detection = was_queued;
-        (void)picosplay_insert(&cnx->queue_data_repeat_tree, packet);
-        packet->is_queued_for_data_repeat = 1;
-        *more_data |= 1;
+
+    if (bytes_next != NULL && (packet->data_repeat_frame > last_frame || packet->data_repeat_frame >= packet->length)) {
+        /* The frame was sent. Remove the packet from the queue, since its
+         * position depends on the frame, and if there is another stream
+         * frame after this one requeue the packet. */
+        picoquic_stream_head_t* stream = NULL;
+
+        picoquic_data_repeat_remove(cnx, packet);
+        packet->is_queued_for_data_repeat = 0;
+        if (packet->data_repeat_frame < packet->length &&
+            picoquic_queue_data_repeat_adjust(cnx, packet, &stream) != 0) {
+            /* signal an error */
+            bytes_next = NULL;
+        }
+        else if (packet->data_repeat_frame < packet->length) {
+            picoquic_data_repeat_insert(cnx, packet, stream);
+            packet->is_queued_for_data_repeat = 1;
+            *more_data |= 1;
+        }
+        if (!packet->is_queued_for_data_repeat) {
+            /* Nothing left in this packet. It can be safely dequeued */
+            picoquic_dequeue_data_repeat_packet(cnx, packet);
+            *packet_dequeued = 1;
+        }
     }
     else {
         *more_data |= 1;
@@ -2245,159 +3023,712 @@ uint8_t* picoquic_copy_stream_frames_for_retransmit(picoquic_cnx_t* cnx,
 }
 
 
-/*
- * Crypto HS frames
+/* Resending lost stream data from the retained send queue.
+ *
+ * When "is_stream_repeat_from_queue" is set, the stream data nodes are not
+ * freed after they are sent, but moved to the "retained" list of the stream
+ * until the peer has acknowledged all their octets. When a packet is lost,
+ * its stream frames are recorded as ranges in the repeat list of the stream,
+ * merged with the contiguous ranges already listed, and the frames are
+ * rebuilt from the retained data when there is room to send them. The lost
+ * packet does not have to wait in the data repeat queue. Frames carrying
+ * data that is not retained, such as data provided by "active" streams in
+ * the prepare to send callback, still go through the data repeat queue.
  */
-
-int picoquic_is_tls_stream_ready(picoquic_cnx_t* cnx)
+void picoquic_stream_retain_sent_node(picoquic_stream_head_t* stream,
+    picoquic_stream_queue_node_t* node, uint64_t stream_offset)
 {
-    int ret = 0;
+    node->stream_offset = stream_offset;
+    node->next_stream_data = NULL;
+    if (stream->last_retained == NULL) {
+        stream->first_retained = node;
+    }
+    else {
+        stream->last_retained->next_stream_data = node;
+    }
+    stream->last_retained = node;
+}
 
-    for (int epoch = 0; epoch < 4; epoch++) {
-        picoquic_stream_head_t* stream = &cnx->tls_stream[epoch];
+void picoquic_stream_release_acked_data(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    picoquic_stream_queue_node_t* node;
 
-        if (stream->send_queue != NULL &&
-            stream->send_queue->length > stream->send_queue->offset &&
-            cnx->crypto_context[epoch].aead_encrypt != NULL) {
-            ret = 1;
-            break;
+    while ((node = stream->first_retained) != NULL &&
+        picoquic_check_sack_list(&stream->sack_list, node->stream_offset, node->stream_offset + node->length - 1) != 0) {
+        stream->first_retained = node->next_stream_data;
+        if (stream->first_retained == NULL) {
+            stream->last_retained = NULL;
         }
+        picoquic_stream_queue_node_free(cnx, node);
     }
-
-    return ret;
 }
 
-const uint8_t* picoquic_parse_crypto_hs_frame(const uint8_t* bytes,
-    const uint8_t* bytes_max, uint64_t * offset, uint64_t * data_length,
-    const uint8_t** data_bytes)
+static void picoquic_insert_repeat_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    if ((bytes = picoquic_frames_varint_decode(bytes + 1, bytes_max, offset)) != NULL &&
-        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, data_length)) != NULL)
-    {
-        *data_bytes = bytes;
-        bytes = picoquic_frames_fixed_skip(bytes, bytes_max, *data_length);
-
+    stream->next_repeat_stream = NULL;
+    stream->previous_repeat_stream = cnx->last_repeat_stream;
+    if (cnx->last_repeat_stream == NULL) {
+        cnx->first_repeat_stream = stream;
     }
-    return bytes;
+    else {
+        cnx->last_repeat_stream->next_repeat_stream = stream;
+    }
+    cnx->last_repeat_stream = stream;
+    stream->is_repeat_stream = 1;
 }
 
-
-const uint8_t* picoquic_decode_crypto_hs_frame(picoquic_cnx_t* cnx, const uint8_t* bytes,
-    const uint8_t* bytes_max,
-    picoquic_stream_data_node_t* received_data,
-    int epoch)
+static void picoquic_remove_repeat_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    uint64_t offset;
-    uint64_t data_length;
-    const uint8_t* data_bytes;
-
-    if ((bytes = picoquic_parse_crypto_hs_frame(bytes, bytes_max, &offset, &data_length, &data_bytes)) == NULL) {
-        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, picoquic_frame_type_crypto_hs);
-    } else {
-        picoquic_stream_head_t* stream = &cnx->tls_stream[epoch];
-
-        if (stream->consumed_offset < offset &&
-            stream->consumed_offset + PICOQUIC_MAX_CRYPTO_BUFFER_GAP < offset + data_length) {
-            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_CRYPTO_BUFFER_EXCEEDED, picoquic_frame_type_crypto_hs);
-            bytes = NULL;
+    if (stream->is_repeat_stream) {
+        if (stream->previous_repeat_stream == NULL) {
+            cnx->first_repeat_stream = stream->next_repeat_stream;
         }
         else {
-            int new_data_available;
-            int ret = picoquic_queue_network_input(cnx->quic, &stream->stream_data_tree, stream->consumed_offset,
-                offset, data_bytes, (size_t)data_length, picoquic_is_last_stream_frame(bytes + data_length, bytes_max),
-                received_data, &new_data_available);
-
-            if (ret != 0) {
-                picoquic_connection_error(cnx, (int64_t)ret, picoquic_frame_type_crypto_hs);
-                bytes = NULL;
-            }
+            stream->previous_repeat_stream->next_repeat_stream = stream->next_repeat_stream;
+        }
+        if (stream->next_repeat_stream == NULL) {
+            cnx->last_repeat_stream = stream->previous_repeat_stream;
+        }
+        else {
+            stream->next_repeat_stream->previous_repeat_stream = stream->previous_repeat_stream;
         }
+        stream->next_repeat_stream = NULL;
+        stream->previous_repeat_stream = NULL;
+        stream->is_repeat_stream = 0;
     }
-
-    return bytes;
 }
 
-static picoquic_stream_head_t* picoquic_crypto_stream_from_ptype(picoquic_cnx_t * cnx, picoquic_packet_type_enum p_type)
+static void picoquic_stream_repeat_dequeue_first(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    picoquic_stream_head_t* stream = NULL;
+    picoquic_stream_repeat_t* repeat = stream->first_repeat;
 
-    switch (p_type) {
-    case picoquic_packet_initial:
-        stream = &cnx->tls_stream[picoquic_epoch_initial];
-        break;
-    case picoquic_packet_0rtt_protected:
-        stream = &cnx->tls_stream[picoquic_epoch_0rtt];
-        break;
-    case picoquic_packet_handshake:
-        stream = &cnx->tls_stream[picoquic_epoch_handshake];
-        break;
-    case picoquic_packet_1rtt_protected:
-        stream = &cnx->tls_stream[picoquic_epoch_1rtt];
-        break;
-    default:
-        break;
+    if (repeat != NULL) {
+        stream->first_repeat = repeat->next_repeat;
+        free(repeat);
+    }
+    if (stream->first_repeat == NULL) {
+        picoquic_remove_repeat_stream(cnx, stream);
     }
-
-    return stream;
 }
 
-int picoquic_process_ack_of_crypto_frame(picoquic_cnx_t* cnx, const uint8_t* bytes,
-    size_t bytes_size, picoquic_packet_type_enum p_type, size_t* consumed)
+void picoquic_stream_retained_free(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    int ret = 0;
-    uint64_t offset = 0;
-    uint64_t data_length = 0;
-    const uint8_t* data_bytes = 0;
-    const uint8_t* byte_zero = bytes;
+    picoquic_stream_queue_node_t* node;
 
-    if ((bytes = picoquic_parse_crypto_hs_frame(bytes, bytes + bytes_size, &offset, &data_length, &data_bytes)) == NULL) {
-        *consumed = bytes_size;
-        ret = -1;
+    while ((node = stream->first_retained) != NULL) {
+        stream->first_retained = node->next_stream_data;
+        picoquic_stream_queue_node_free(cnx, node);
     }
-    else {
-        picoquic_stream_head_t* stream = picoquic_crypto_stream_from_ptype(cnx, p_type);
-        *consumed = (bytes - byte_zero);
-
-        if (stream != NULL) {
-            (void)picoquic_update_sack_list(&stream->sack_list,
-                offset, offset + data_length - 1, 0);
-        }
+    stream->last_retained = NULL;
+    while (stream->first_repeat != NULL) {
+        picoquic_stream_repeat_dequeue_first(cnx, stream);
     }
-
-    return ret;
 }
 
-int picoquic_check_crypto_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
-    size_t bytes_size, picoquic_packet_type_enum p_type, int* no_need_to_repeat)
+/* Copy "length" octets of sent data starting at "offset", either from the
+ * retained nodes or from the part of the first node of the send queue that
+ * was already sent. If "bytes" is NULL, only check that the data is available.
+ * Returns -1 if some of the octets are not retained.
+ */
+int picoquic_stream_copy_retained(picoquic_stream_head_t* stream, uint64_t offset, uint8_t* bytes, size_t length)
 {
-    int ret = 0;
-    uint64_t offset = 0;
-    uint64_t data_length = 0;
-    const uint8_t* data_bytes = 0;
+    picoquic_stream_queue_node_t* node = stream->first_retained;
+    int is_queue_head = 0;
 
-    if ((bytes = picoquic_parse_crypto_hs_frame(bytes, bytes + bytes_size, &offset, &data_length, &data_bytes)) == NULL) {
-        *no_need_to_repeat = 1;
-        ret = -1;
+    if (node == NULL) {
+        node = stream->send_queue;
+        is_queue_head = 1;
     }
-    else {
-        picoquic_stream_head_t* stream = picoquic_crypto_stream_from_ptype(cnx, p_type);
 
-        if (stream == NULL) {
-            /* Stream was deleted, probably already closed */
-            *no_need_to_repeat = 1;
+    while (length > 0 && node != NULL) {
+        uint64_t node_offset = (is_queue_head) ? stream->sent_offset - node->offset : node->stream_offset;
+        size_t node_length = (is_queue_head) ? (size_t)node->offset : node->length;
+
+        if (offset < node_offset) {
+            /* These octets were not retained */
+            break;
         }
-        else {
-            /* Check whether the ack was already received */
-            *no_need_to_repeat = picoquic_check_sack_list(&stream->sack_list, offset, offset + data_length - 1);
+        else if (offset < node_offset + node_length) {
+            size_t index = (size_t)(offset - node_offset);
+            size_t copied = node_length - index;
+
+            if (copied > length) {
+                copied = length;
+            }
+            if (bytes != NULL) {
+                memcpy(bytes, node->bytes + index, copied);
+                bytes += copied;
+            }
+            offset += copied;
+            length -= copied;
+        }
+
+        if (is_queue_head) {
+            node = NULL;
+        }
+        else if ((node = node->next_stream_data) == NULL) {
+            node = stream->send_queue;
+            is_queue_head = 1;
         }
     }
 
-    return ret;
+    return (length == 0) ? 0 : -1;
 }
 
-uint8_t* picoquic_format_crypto_hs_frame(picoquic_stream_head_t* stream, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack)
+/* Record the range [offset, offset + data_length[ in the repeat list of the stream.
+ * The data must be retained. */
+static int picoquic_queue_stream_range_repeat(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
+    uint64_t offset, size_t data_length, int fin)
 {
-    uint8_t* bytes0 = bytes;
+    int ret = -1;
+
+    if (picoquic_stream_copy_retained(stream, offset, NULL, data_length) == 0) {
+        picoquic_stream_repeat_t** pnext = &stream->first_repeat;
+        picoquic_stream_repeat_t* repeat = NULL;
+
+        /* Skip the ranges that end before the new one */
+        while (*pnext != NULL && (*pnext)->offset + (*pnext)->length < offset) {
+            pnext = &(*pnext)->next_repeat;
+        }
+        if (*pnext != NULL && (*pnext)->offset <= offset + data_length) {
+            /* Merge with the overlapping or contiguous range, so the lost
+             * packets are resent as large contiguous frames */
+            repeat = *pnext;
+            if (offset < repeat->offset) {
+                repeat->length += repeat->offset - offset;
+                repeat->offset = offset;
+            }
+            if (offset + data_length > repeat->offset + repeat->length) {
+                repeat->length = offset + data_length - repeat->offset;
+            }
+            repeat->is_fin |= fin;
+            /* The extended range may now reach the next ones */
+            while (repeat->next_repeat != NULL &&
+                repeat->next_repeat->offset <= repeat->offset + repeat->length) {
+                picoquic_stream_repeat_t* next = repeat->next_repeat;
+
+                if (next->offset + next->length > repeat->offset + repeat->length) {
+                    repeat->length = next->offset + next->length - repeat->offset;
+                }
+                repeat->is_fin |= next->is_fin;
+                repeat->next_repeat = next->next_repeat;
+                free(next);
+            }
+            ret = 0;
+        }
+        else if ((repeat = (picoquic_stream_repeat_t*)malloc(sizeof(picoquic_stream_repeat_t))) != NULL) {
+            repeat->offset = offset;
+            repeat->length = data_length;
+            repeat->is_fin = fin;
+            repeat->next_repeat = *pnext;
+            *pnext = repeat;
+            ret = 0;
+        }
+        if (ret == 0 && !stream->is_repeat_stream) {
+            picoquic_insert_repeat_stream(cnx, stream);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_queue_stream_frame_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t bytes_max)
+{
+    int ret = -1;
+    uint64_t stream_id;
+    uint64_t offset;
+    size_t data_length;
+    size_t consumed;
+    int fin;
+    picoquic_stream_head_t* stream;
+
+    if (picoquic_parse_stream_header(bytes, bytes_max, &stream_id, &offset, &data_length, &fin, &consumed) == 0 &&
+        (stream = picoquic_find_stream(cnx, stream_id)) != NULL) {
+        ret = picoquic_queue_stream_range_repeat(cnx, stream, offset, data_length, fin);
+    }
+
+    return ret;
+}
+
+/* Stream metadata frames are never sent. Once a packet is queued for
+ * retransmit, each stream frame whose data is retained in the stream is
+ * replaced by a metadata frame holding the stream ID, offset, length and
+ * FIN bit of the frame. The frame is encoded as the varint type, the
+ * three varint values, and one byte for the FIN bit.
+ */
+#define PICOQUIC_STREAM_METADATA_FRAME_MAX (2 + 3 * 8 + 1)
+
+uint8_t* picoquic_format_stream_metadata_frame(uint8_t* bytes, uint8_t* bytes_max,
+    uint64_t stream_id, uint64_t offset, size_t data_length, int fin)
+{
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_frame_type_stream_metadata)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, stream_id)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, offset)) != NULL &&
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, data_length)) != NULL) {
+        bytes = picoquic_frames_uint8_encode(bytes, bytes_max, (fin) ? 1 : 0);
+    }
+
+    return bytes;
+}
+
+const uint8_t* picoquic_parse_stream_metadata_frame(const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t* stream_id, uint64_t* offset, size_t* data_length, int* fin)
+{
+    uint64_t frame_type = 0;
+    uint8_t fin_byte = 0;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_type)) == NULL ||
+        frame_type != picoquic_frame_type_stream_metadata ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, stream_id)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, offset)) == NULL ||
+        (bytes = picoquic_frames_varlen_decode(bytes, bytes_max, data_length)) == NULL ||
+        (bytes = picoquic_frames_uint8_decode(bytes, bytes_max, &fin_byte)) == NULL) {
+        bytes = NULL;
+    }
+    else {
+        *fin = fin_byte;
+    }
+
+    return bytes;
+}
+
+int picoquic_is_stream_metadata_frame(const uint8_t* bytes, size_t bytes_max)
+{
+    uint64_t frame_type = 0;
+
+    return picoquic_frames_varint_decode(bytes, bytes + bytes_max, &frame_type) != NULL &&
+        frame_type == picoquic_frame_type_stream_metadata;
+}
+
+static const uint8_t* picoquic_skip_stream_metadata_frame(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    if ((bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL &&
+        (bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL &&
+        (bytes = picoquic_frames_varint_skip(bytes, bytes_max)) != NULL) {
+        bytes = (bytes < bytes_max) ? bytes + 1 : NULL;
+    }
+
+    return bytes;
+}
+
+/* Record the range described by a stream metadata frame in the repeat list
+ * of the stream. The retained nodes are only freed once all their octets are
+ * acknowledged, in order, so the part of the range below the first retained
+ * octet was already acknowledged and is not repeated.
+ */
+int picoquic_queue_stream_metadata_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t bytes_max)
+{
+    int ret = -1;
+    uint64_t stream_id;
+    uint64_t offset;
+    size_t data_length;
+    int fin;
+    picoquic_stream_head_t* stream;
+
+    if (picoquic_parse_stream_metadata_frame(bytes, bytes + bytes_max, &stream_id, &offset, &data_length, &fin) != NULL) {
+        if ((stream = picoquic_find_stream(cnx, stream_id)) == NULL || stream->reset_sent) {
+            /* Nothing left to repeat */
+            ret = 0;
+        }
+        else {
+            uint64_t retained_offset = stream->sent_offset;
+
+            if (stream->first_retained != NULL) {
+                retained_offset = stream->first_retained->stream_offset;
+            }
+            else if (stream->send_queue != NULL) {
+                retained_offset -= stream->send_queue->offset;
+            }
+            if (offset < retained_offset) {
+                size_t acked_length = (retained_offset - offset > data_length) ? data_length : (size_t)(retained_offset - offset);
+
+                offset += acked_length;
+                data_length -= acked_length;
+            }
+            ret = picoquic_queue_stream_range_repeat(cnx, stream, offset, data_length, fin);
+        }
+    }
+
+    return ret;
+}
+
+/* Strip the stream data from a packet queued for retransmit. Lost stream
+ * frames are rebuilt from the retained send queue, so the packet only needs
+ * the metadata of the frames whose data is retained. These frames are
+ * replaced by stream metadata frames, the padding is removed, and the other
+ * frames are moved down. The length of the packet is updated, and the
+ * number of bytes removed is added to "stripped_length", so that the sent
+ * length is preserved for congestion control. Returns the number of bytes
+ * removed.
+ */
+size_t picoquic_strip_retained_stream_data(picoquic_cnx_t* cnx, picoquic_packet_t* packet)
+{
+    size_t read_index = packet->offset;
+    size_t write_index = packet->offset;
+    size_t stripped = 0;
+
+    while (read_index < packet->length) {
+        size_t frame_length = 0;
+        int is_pure_ack = 0;
+        uint8_t metadata[PICOQUIC_STREAM_METADATA_FRAME_MAX];
+        size_t metadata_length = 0;
+        uint8_t first_byte = packet->bytes[read_index];
+
+        if (picoquic_skip_frame(&packet->bytes[read_index], packet->length - read_index, &frame_length, &is_pure_ack) != 0) {
+            /* Malformed frame, keep the rest of the packet as is */
+            frame_length = packet->length - read_index;
+        }
+        else if (first_byte == picoquic_frame_type_padding) {
+            read_index += frame_length;
+            continue;
+        }
+        else if (PICOQUIC_IN_RANGE(first_byte, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+            uint64_t stream_id;
+            uint64_t offset;
+            size_t data_length;
+            size_t consumed;
+            int fin;
+            picoquic_stream_head_t* stream;
+            uint8_t* bytes_next;
+
+            if (picoquic_parse_stream_header(&packet->bytes[read_index], frame_length,
+                &stream_id, &offset, &data_length, &fin, &consumed) == 0 &&
+                (stream = picoquic_find_stream(cnx, stream_id)) != NULL &&
+                picoquic_stream_copy_retained(stream, offset, NULL, data_length) == 0 &&
+                (bytes_next = picoquic_format_stream_metadata_frame(metadata, metadata + sizeof(metadata),
+                    stream_id, offset, data_length, fin)) != NULL &&
+                (size_t)(bytes_next - metadata) < frame_length) {
+                metadata_length = bytes_next - metadata;
+            }
+        }
+
+        if (metadata_length > 0) {
+            memcpy(&packet->bytes[write_index], metadata, metadata_length);
+            write_index += metadata_length;
+            cnx->nb_stream_frames_stripped++;
+        }
+        else {
+            if (write_index < read_index) {
+                memmove(&packet->bytes[write_index], &packet->bytes[read_index], frame_length);
+            }
+            write_index += frame_length;
+        }
+        read_index += frame_length;
+    }
+
+    if (write_index < packet->length) {
+        stripped = packet->length - write_index;
+        packet->stripped_length += stripped;
+        packet->length = write_index;
+    }
+
+    return stripped;
+}
+
+picoquic_stream_head_t* picoquic_first_repeat_stream(picoquic_cnx_t* cnx)
+{
+    picoquic_stream_head_t* first_stream = cnx->first_repeat_stream;
+    picoquic_stream_head_t* stream = (first_stream == NULL) ? NULL : first_stream->next_repeat_stream;
+
+    while (stream != NULL) {
+        if (stream->stream_priority < first_stream->stream_priority) {
+            first_stream = stream;
+        }
+        stream = stream->next_repeat_stream;
+    }
+
+    return first_stream;
+}
+
+/* Rebuild one stream frame from the first repeat range of the stream.
+ * Sets "is_packet_full" if the range could not be sent completely.
+ */
+static uint8_t* picoquic_copy_stream_repeat(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
+    uint8_t* bytes_next, uint8_t* bytes_max, int* is_packet_full)
+{
+    picoquic_stream_repeat_t* repeat = stream->first_repeat;
+    uint64_t offset = repeat->offset;
+    uint64_t end_offset = repeat->offset + repeat->length;
+    int is_needed = !stream->reset_requested && !stream->reset_sent;
+
+    if (is_needed) {
+        /* Skip the octets already acknowledged at the beginning of the range.
+         * The FIN mark is acknowledged as one octet after the last. */
+        picoquic_sack_item_t* sack = picoquic_sack_find_range_below_number(&stream->sack_list, NULL, offset);
+
+        if (sack != NULL && sack->end_of_sack_range >= offset) {
+            offset = sack->end_of_sack_range + 1;
+        }
+        if (offset > end_offset || (offset == end_offset && !repeat->is_fin)) {
+            is_needed = 0;
+        }
+        else if ((stream->deadline != 0 || stream->first_deadline != NULL) &&
+            picoquic_stream_data_is_expired(stream, offset, end_offset - offset, picoquic_get_quic_time(cnx->quic))) {
+            /* Too late to repeat that data, reset the stream instead */
+            picoquic_stream_deadline_expire(cnx, stream);
+            is_needed = 0;
+        }
+    }
+
+    if (is_needed) {
+        uint8_t* bytes_first = bytes_next;
+        uint8_t* bytes_data = picoquic_format_stream_frame_header(bytes_next, bytes_max, stream->stream_id, offset);
+        size_t data_available = (size_t)(end_offset - offset);
+        size_t data_sent = 0;
+        int fin_sent = 0;
+
+        if (bytes_data == NULL || bytes_data >= bytes_max) {
+            /* Cannot encode anything! -- need to wait for another opportunity */
+            bytes_next = bytes_first;
+            *is_packet_full = 1;
+        }
+        else {
+            uint8_t* after_length = picoquic_frames_varint_encode(bytes_data, bytes_max, data_available);
+
+            if (after_length != NULL && after_length + data_available <= bytes_max) {
+                /* Can encode everything in a natural way */
+                *bytes_first |= 2;
+                *bytes_first |= repeat->is_fin;
+                bytes_next = after_length;
+                data_sent = data_available;
+                fin_sent = repeat->is_fin;
+            }
+            else if (bytes_data + data_available <= bytes_max) {
+                /* Everything fits if we remove the length, inserting initial padding if needed */
+                size_t pad_required = (bytes_max - bytes_data) - data_available;
+
+                *bytes_first |= repeat->is_fin;
+                if (pad_required > 0) {
+                    memmove(bytes_first + pad_required, bytes_first, bytes_data - bytes_first);
+                    memset(bytes_first, 0, pad_required);
+                }
+                bytes_next = bytes_data + pad_required;
+                data_sent = data_available;
+                fin_sent = repeat->is_fin;
+            }
+            else if ((size_t)(bytes_max - bytes_data) >= PICOQUIC_MIN_STREAM_DATA_FRAGMENT) {
+                /* Buffer is too short -- do not send the FIN bit, do not set the length, just copy bytes */
+                bytes_next = bytes_data;
+                data_sent = bytes_max - bytes_data;
+                *is_packet_full = 1;
+            }
+            else {
+                bytes_next = bytes_first;
+                *is_packet_full = 1;
+            }
+
+            if (data_sent > 0 &&
+                picoquic_stream_copy_retained(stream, offset, bytes_next, data_sent) != 0) {
+                /* The data should be retained until acked. Fall back to a connection error. */
+                (void)picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0,
+                    "retained stream data missing, cannot be resent");
+                bytes_next = bytes_first;
+                data_sent = 0;
+                fin_sent = 0;
+                is_needed = 0;
+            }
+            else {
+                bytes_next += data_sent;
+                if (bytes_next > bytes_first) {
+                    cnx->nb_stream_frames_rebuilt++;
+                }
+            }
+        }
+
+        if (is_needed) {
+            if (data_sent == data_available && fin_sent == repeat->is_fin) {
+                picoquic_stream_repeat_dequeue_first(cnx, stream);
+            }
+            else {
+                repeat->offset = offset + data_sent;
+                repeat->length = data_available - data_sent;
+            }
+        }
+    }
+
+    if (!is_needed) {
+        picoquic_stream_repeat_dequeue_first(cnx, stream);
+    }
+
+    return bytes_next;
+}
+
+uint8_t* picoquic_copy_stream_repeats_for_retransmit(picoquic_cnx_t* cnx,
+    uint8_t* bytes_next, uint8_t* bytes_max, uint64_t current_priority, int* more_data, int* is_pure_ack)
+{
+    picoquic_stream_head_t* stream;
+    int is_packet_full = 0;
+
+    while (!is_packet_full && bytes_next < bytes_max &&
+        (stream = picoquic_first_repeat_stream(cnx)) != NULL &&
+        stream->stream_priority <= current_priority) {
+        uint8_t* bytes_first = bytes_next;
+
+        bytes_next = picoquic_copy_stream_repeat(cnx, stream, bytes_next, bytes_max, &is_packet_full);
+        if (bytes_next > bytes_first) {
+            *is_pure_ack = 0;
+        }
+    }
+
+    *more_data |= (cnx->first_repeat_stream != NULL);
+
+    return bytes_next;
+}
+
+
+/*
+ * Crypto HS frames
+ */
+
+int picoquic_is_tls_stream_ready(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+
+    for (int epoch = 0; epoch < 4; epoch++) {
+        picoquic_stream_head_t* stream = &cnx->tls_stream[epoch];
+
+        if (stream->send_queue != NULL &&
+            stream->send_queue->length > stream->send_queue->offset &&
+            cnx->crypto_context[epoch].aead_encrypt != NULL) {
+            ret = 1;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+const uint8_t* picoquic_parse_crypto_hs_frame(const uint8_t* bytes,
+    const uint8_t* bytes_max, uint64_t * offset, uint64_t * data_length,
+    const uint8_t** data_bytes)
+{
+    if ((bytes = picoquic_frames_varint_decode(bytes + 1, bytes_max, offset)) != NULL &&
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, data_length)) != NULL)
+    {
+        *data_bytes = bytes;
+        bytes = picoquic_frames_fixed_skip(bytes, bytes_max, *data_length);
+
+    }
+    return bytes;
+}
+
+
+const uint8_t* picoquic_decode_crypto_hs_frame(picoquic_cnx_t* cnx, const uint8_t* bytes,
+    const uint8_t* bytes_max,
+    picoquic_stream_data_node_t* received_data,
+    int epoch)
+{
+    uint64_t offset;
+    uint64_t data_length;
+    const uint8_t* data_bytes;
+
+    if ((bytes = picoquic_parse_crypto_hs_frame(bytes, bytes_max, &offset, &data_length, &data_bytes)) == NULL) {
+        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, picoquic_frame_type_crypto_hs);
+    } else {
+        picoquic_stream_head_t* stream = &cnx->tls_stream[epoch];
+
+        if (stream->consumed_offset < offset &&
+            stream->consumed_offset + PICOQUIC_MAX_CRYPTO_BUFFER_GAP < offset + data_length) {
+            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_CRYPTO_BUFFER_EXCEEDED, picoquic_frame_type_crypto_hs);
+            bytes = NULL;
+        }
+        else {
+            int new_data_available;
+            int ret = picoquic_queue_network_input(cnx->quic, cnx, &stream->stream_data_tree, stream->consumed_offset,
+                offset, data_bytes, (size_t)data_length, picoquic_is_last_stream_frame(bytes + data_length, bytes_max),
+                received_data, &new_data_available);
+
+            if (ret != 0) {
+                picoquic_connection_error(cnx, (int64_t)ret, picoquic_frame_type_crypto_hs);
+                bytes = NULL;
+            }
+        }
+    }
+
+    return bytes;
+}
+
+static picoquic_stream_head_t* picoquic_crypto_stream_from_ptype(picoquic_cnx_t * cnx, picoquic_packet_type_enum p_type)
+{
+    picoquic_stream_head_t* stream = NULL;
+
+    switch (p_type) {
+    case picoquic_packet_initial:
+        stream = &cnx->tls_stream[picoquic_epoch_initial];
+        break;
+    case picoquic_packet_0rtt_protected:
+        stream = &cnx->tls_stream[picoquic_epoch_0rtt];
+        break;
+    case picoquic_packet_handshake:
+        stream = &cnx->tls_stream[picoquic_epoch_handshake];
+        break;
+    case picoquic_packet_1rtt_protected:
+        stream = &cnx->tls_stream[picoquic_epoch_1rtt];
+        break;
+    default:
+        break;
+    }
+
+    return stream;
+}
+
+int picoquic_process_ack_of_crypto_frame(picoquic_cnx_t* cnx, const uint8_t* bytes,
+    size_t bytes_size, picoquic_packet_type_enum p_type, size_t* consumed)
+{
+    int ret = 0;
+    uint64_t offset = 0;
+    uint64_t data_length = 0;
+    const uint8_t* data_bytes = 0;
+    const uint8_t* byte_zero = bytes;
+
+    if ((bytes = picoquic_parse_crypto_hs_frame(bytes, bytes + bytes_size, &offset, &data_length, &data_bytes)) == NULL) {
+        *consumed = bytes_size;
+        ret = -1;
+    }
+    else {
+        picoquic_stream_head_t* stream = picoquic_crypto_stream_from_ptype(cnx, p_type);
+        *consumed = (bytes - byte_zero);
+
+        if (stream != NULL) {
+            (void)picoquic_update_sack_list(&stream->sack_list,
+                offset, offset + data_length - 1, 0);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_check_crypto_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
+    size_t bytes_size, picoquic_packet_type_enum p_type, int* no_need_to_repeat)
+{
+    int ret = 0;
+    uint64_t offset = 0;
+    uint64_t data_length = 0;
+    const uint8_t* data_bytes = 0;
+
+    if ((bytes = picoquic_parse_crypto_hs_frame(bytes, bytes + bytes_size, &offset, &data_length, &data_bytes)) == NULL) {
+        *no_need_to_repeat = 1;
+        ret = -1;
+    }
+    else {
+        picoquic_stream_head_t* stream = picoquic_crypto_stream_from_ptype(cnx, p_type);
+
+        if (stream == NULL) {
+            /* Stream was deleted, probably already closed */
+            *no_need_to_repeat = 1;
+        }
+        else {
+            /* Check whether the ack was already received */
+            *no_need_to_repeat = picoquic_check_sack_list(&stream->sack_list, offset, offset + data_length - 1);
+        }
+    }
+
+    return ret;
+}
+
+uint8_t* picoquic_format_crypto_hs_frame(picoquic_stream_head_t* stream, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack)
+{
+    uint8_t* bytes0 = bytes;
 
     if (stream->send_queue != NULL && stream->send_queue->length > stream->send_queue->offset) {
         /* Check that there is enough room for at least 2 content bytes */
@@ -2430,8 +3761,7 @@ uint8_t* picoquic_format_crypto_hs_frame(picoquic_stream_head_t* stream, uint8_t
                     stream->send_queue->offset += length;
                     if (stream->send_queue->offset >= stream->send_queue->length) {
                         picoquic_stream_queue_node_t* next = stream->send_queue->next_stream_data;
-                        free(stream->send_queue->bytes);
-                        free(stream->send_queue);
+                        picoquic_stream_queue_node_free(stream->cnx, stream->send_queue);
                         stream->send_queue = next;
                     }
 
@@ -2498,84 +3828,113 @@ int picoquic_parse_ack_header(uint8_t const* bytes, size_t bytes_max,
     return ret;
 }
 
-picoquic_packet_t* picoquic_check_spurious_retransmission(picoquic_cnx_t* cnx,
-    picoquic_packet_context_enum pc, picoquic_packet_context_t * pkt_ctx,
-    uint64_t start_of_range, uint64_t end_of_range, uint64_t current_time, uint64_t time_stamp,
-    picoquic_packet_t* p, picoquic_packet_data_t* packet_data)
+/* Process the acknowledgement of a packet that was considered lost and repeated. */
+static void picoquic_process_spurious_packet(picoquic_cnx_t* cnx,
+    picoquic_packet_context_enum pc, picoquic_packet_context_t* pkt_ctx,
+    picoquic_packet_t* p, uint64_t current_time, picoquic_packet_data_t* packet_data)
 {
-    while (p != NULL && p->sequence_number >= start_of_range) {
-        picoquic_packet_t* should_delete = NULL;
+    uint64_t spurious_rtt = current_time - p->send_time;
+    uint64_t reorder_delay = pkt_ctx->latest_time_acknowledged - p->send_time;
+    uint64_t reorder_gap = pkt_ctx->highest_acknowledged - p->sequence_number;
+    picoquic_path_t * old_path = p->send_path;
 
-        if ( p->sequence_number <= end_of_range) {
+    /* If the packet contained an ACK frame, perform the ACK of ACK pruning logic.
+     * Record stream data as acknowledged, signal datagram frames as acknowledged.
+     */
+    picoquic_process_ack_of_frames(cnx, p, 1, current_time);
 
-            uint64_t spurious_rtt = current_time - p->send_time;
-            uint64_t reorder_delay = pkt_ctx->latest_time_acknowledged - p->send_time;
-            uint64_t reorder_gap = pkt_ctx->highest_acknowledged - p->sequence_number;
-            picoquic_path_t * old_path = p->send_path;
 
-            /* If the packet contained an ACK frame, perform the ACK of ACK pruning logic.
-             * Record stream data as acknowledged, signal datagram frames as acknowledged.
-             */
-            picoquic_process_ack_of_frames(cnx, p, 1, current_time);
+    /* Update congestion control and statistics */
+    if (old_path != NULL) {
+        old_path->nb_spurious++;
+        /* If this was the
+         * packet that triggered a retransmit, reset the retransmit count */
+        if (p->sequence_number >= picoquic_get_ack_number(cnx, old_path, pc)) {
+            old_path->nb_retransmit = 0;
+        }
 
+        /* Record the updated delay and CC data in packet context
+         * TODO: verify that accounting for acked data at this point is correct.
+         */
+        picoquic_record_ack_packet_data(packet_data, p);
 
-            /* Update congestion control and statistics */
-            if (old_path != NULL) {
-                old_path->nb_spurious++;
-                /* If this was the
-                 * packet that triggered a retransmit, reset the retransmit count */
-                if (p->sequence_number >= picoquic_get_ack_number(cnx, old_path, pc)) {
-                    old_path->nb_retransmit = 0;
-                }
+        if (PICOQUIC_PACKET_SENT_LENGTH(p) + p->checksum_overhead > old_path->send_mtu) {
+            old_path->send_mtu = PICOQUIC_PACKET_SENT_LENGTH(p) + p->checksum_overhead;
+            if (old_path->send_mtu > old_path->send_mtu_max_tried) {
+                old_path->send_mtu_max_tried = old_path->send_mtu;
+            }
+            old_path->mtu_probe_sent = 0; 
+        }
 
-                /* Record the updated delay and CC data in packet context
-                 * TODO: verify that accounting for acked data at this point is correct.
-                 */
-                picoquic_record_ack_packet_data(packet_data, p);
+        if (spurious_rtt > old_path->max_spurious_rtt) {
+            old_path->max_spurious_rtt = spurious_rtt;
+        }
 
-                if (p->length + p->checksum_overhead > old_path->send_mtu) {
-                    old_path->send_mtu = p->length + p->checksum_overhead;
-                    if (old_path->send_mtu > old_path->send_mtu_max_tried) {
-                        old_path->send_mtu_max_tried = old_path->send_mtu;
-                    }
-                    old_path->mtu_probe_sent = 0; 
-                }
+        if (reorder_delay > old_path->max_reorder_delay) {
+            old_path->max_reorder_delay = reorder_delay;
+        }
 
-                if (spurious_rtt > old_path->max_spurious_rtt) {
-                    old_path->max_spurious_rtt = spurious_rtt;
-                }
+        if (reorder_gap > old_path->max_reorder_gap) {
+            old_path->max_reorder_gap = reorder_gap;
+        }
 
-                if (reorder_delay > old_path->max_reorder_delay) {
-                    old_path->max_reorder_delay = reorder_delay;
-                }
+        picoquic_reorder_window_on_spurious(old_path, reorder_gap, current_time);
 
-                if (reorder_gap > old_path->max_reorder_gap) {
-                    old_path->max_reorder_gap = reorder_gap;
-                }
+        if (old_path->total_bytes_lost > PICOQUIC_PACKET_SENT_LENGTH(p)) {
+            old_path->total_bytes_lost -= PICOQUIC_PACKET_SENT_LENGTH(p);
+        }
+        else {
+            old_path->total_bytes_lost = 0;
+        }
 
-                if (old_path->total_bytes_lost > p->length) {
-                    old_path->total_bytes_lost -= p->length;
-                }
-                else {
-                    old_path->total_bytes_lost = 0;
-                }
+        if (cnx->congestion_alg != NULL) {
+            picoquic_per_ack_state_t ack_state = { 0 };
+            ack_state.lost_packet_number = p->sequence_number;
+            cnx->congestion_alg->alg_notify(cnx, old_path, picoquic_congestion_notification_spurious_repeat,
+               &ack_state, current_time);
+            PICOQUIC_PROBE_CC_NOTIFY(cnx, old_path, picoquic_congestion_notification_spurious_repeat);
+        }
+    }
+
+    cnx->nb_spurious++;
+    if (cnx->quic->metrics != NULL) {
+        cnx->quic->metrics->live.nb_spurious_losses++;
+    }
+}
 
-                if (cnx->congestion_alg != NULL) {
-                    picoquic_per_ack_state_t ack_state = { 0 };
-                    ack_state.lost_packet_number = p->sequence_number;
-                    cnx->congestion_alg->alg_notify(cnx, old_path, picoquic_congestion_notification_spurious_repeat,
-                       &ack_state, current_time);
+picoquic_packet_t* picoquic_check_spurious_retransmission(picoquic_cnx_t* cnx,
+    picoquic_packet_context_enum pc, picoquic_packet_context_t * pkt_ctx,
+    uint64_t start_of_range, uint64_t end_of_range, uint64_t current_time, uint64_t time_stamp,
+    picoquic_packet_t* p, picoquic_packet_data_t* packet_data)
+{
+    if (!pkt_ctx->retransmitted_index.is_disabled &&
+        end_of_range - start_of_range < pkt_ctx->retransmitted_queue_size) {
+        /* The range is shorter than the queue: look up each number in the index */
+        for (uint64_t pn = start_of_range; pn <= end_of_range; pn++) {
+            picoquic_packet_t* q = picoquic_packet_index_find(&pkt_ctx->retransmitted_index, pn);
+            if (q != NULL) {
+                if (q == p) {
+                    p = p->packet_next;
                 }
+                picoquic_process_spurious_packet(cnx, pc, pkt_ctx, q, current_time, packet_data);
+                picoquic_dequeue_retransmitted_packet(cnx, pkt_ctx, q);
             }
-
-            cnx->nb_spurious++;
-            should_delete = p;
         }
+    }
+    else {
+        while (p != NULL && p->sequence_number >= start_of_range) {
+            picoquic_packet_t* should_delete = NULL;
+
+            if (p->sequence_number <= end_of_range) {
+                picoquic_process_spurious_packet(cnx, pc, pkt_ctx, p, current_time, packet_data);
+                should_delete = p;
+            }
 
-        p = p->packet_next;
+            p = p->packet_next;
 
-        if (should_delete != NULL) {
-            picoquic_dequeue_retransmitted_packet(cnx, pkt_ctx, should_delete);
+            if (should_delete != NULL) {
+                picoquic_dequeue_retransmitted_packet(cnx, pkt_ctx, should_delete);
+            }
         }
     }
 
@@ -2634,6 +3993,7 @@ void picoquic_estimate_path_bandwidth(picoquic_cnx_t * cnx, picoquic_path_t* pat
                 path_x->bandwidth_estimate = bw_estimate;
                 if (!rs_is_path_limited || bw_estimate > path_x->bandwidth_estimate) {
                     if (path_x == cnx->path[0]){
+                        picoquic_adaptive_ack_frequency_update(cnx, current_time);
                         if (cnx->is_ack_frequency_negotiated) {
                             /* Compute the desired value of the ack frequency*/
                             uint64_t ack_gap;
@@ -2770,7 +4130,7 @@ static uint64_t picoquic_compute_ack_gap(picoquic_cnx_t* cnx, uint64_t data_rate
         ack_gap = ack_gap_min;
     }
     else if (ack_gap > 32) {
-        if (cnx->is_multipath_enabled ||
+        if (PICOQUIC_CNX_IS_MULTIPATH(cnx) ||
             cnx->congestion_alg == NULL ||
             cnx->congestion_alg->congestion_algorithm_number == PICOQUIC_CC_ALGO_NUMBER_NEW_RENO ||
             cnx->congestion_alg->congestion_algorithm_number == PICOQUIC_CC_ALGO_NUMBER_FAST
@@ -2808,6 +4168,120 @@ uint64_t picoquic_compute_ack_delay_max(picoquic_cnx_t* cnx, uint64_t rtt, uint6
     return ack_delay_max;
 }
 
+/* Adaptive ACK frequency.
+ * While congestion control probes for bandwidth, the gap is halved, so the
+ * sender gets faster feedback. In steady state, the gap is allowed to grow
+ * beyond the default limits, up to 1/4th of the packets in flight, so there
+ * are still at least 4 ACKs per RTT. If the network thread is busy more than
+ * half of the time, the gap is doubled.
+ */
+#define PICOQUIC_ADAPTIVE_ACK_GAP_MAX 256
+#define PICOQUIC_ADAPTIVE_ACK_CPU_LOAD_HIGH 500
+#define PICOQUIC_ADAPTIVE_ACK_REORDERING_MAX 16
+
+static int picoquic_adaptive_ack_is_probing(picoquic_cnx_t* cnx)
+{
+    int is_probing;
+
+    if (cnx->congestion_alg != NULL && cnx->congestion_alg->congestion_algorithm_number == PICOQUIC_CC_ALGO_NUMBER_BBR) {
+        is_probing = picoquic_bbr_is_probing(cnx->path[0]);
+    }
+    else {
+        is_probing = !cnx->path[0]->is_ssthresh_initialized;
+    }
+
+    return is_probing;
+}
+
+static void picoquic_adaptive_ack_gap(picoquic_cnx_t* cnx, uint64_t nb_packets, uint64_t* ack_gap)
+{
+    uint64_t ack_gap_max = nb_packets / 4;
+
+    if (ack_gap_max > PICOQUIC_ADAPTIVE_ACK_GAP_MAX) {
+        ack_gap_max = PICOQUIC_ADAPTIVE_ACK_GAP_MAX;
+    }
+
+    if (picoquic_adaptive_ack_is_probing(cnx)) {
+        *ack_gap /= 2;
+    }
+    else {
+        if (*ack_gap < ack_gap_max) {
+            *ack_gap = ack_gap_max;
+        }
+        if (cnx->ack_cpu_load_permille > PICOQUIC_ADAPTIVE_ACK_CPU_LOAD_HIGH) {
+            *ack_gap *= 2;
+            if (*ack_gap > PICOQUIC_ADAPTIVE_ACK_GAP_MAX) {
+                *ack_gap = PICOQUIC_ADAPTIVE_ACK_GAP_MAX;
+            }
+        }
+    }
+
+    if (*ack_gap < 2) {
+        *ack_gap = 2;
+    }
+}
+
+/* The reordering threshold covers the largest reordering gap observed on
+ * the path, so that reordered packets do not trigger immediate ACKs. */
+static uint64_t picoquic_ack_frequency_reordering_threshold(picoquic_cnx_t* cnx)
+{
+    uint64_t reordering_threshold = (cnx->ack_ignore_order_local) ? 0 : 1;
+
+    if (reordering_threshold != 0 && cnx->quic->is_adaptive_ack_frequency_enabled) {
+        reordering_threshold = cnx->path[0]->max_reorder_gap + 1;
+        if (reordering_threshold > PICOQUIC_ADAPTIVE_ACK_REORDERING_MAX) {
+            reordering_threshold = PICOQUIC_ADAPTIVE_ACK_REORDERING_MAX;
+        }
+    }
+
+    return reordering_threshold;
+}
+
+/* Called when ACKs are received on the default path. Tracks the CPU load
+ * of the network thread, and asks for an ACK frequency update and an
+ * IMMEDIATE_ACK when congestion control starts probing. */
+void picoquic_adaptive_ack_frequency_update(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    if (cnx->is_ack_frequency_negotiated && cnx->quic->is_adaptive_ack_frequency_enabled) {
+        int is_probing = picoquic_adaptive_ack_is_probing(cnx);
+
+        if (is_probing != cnx->is_ack_frequency_probing) {
+            cnx->is_ack_frequency_probing = is_probing;
+            cnx->is_ack_frequency_updated = 1;
+            if (is_probing) {
+                cnx->is_immediate_ack_pending = 1;
+            }
+        }
+
+        if (cnx->quic->is_cpu_accounting_enabled) {
+            if (cnx->ack_cpu_epoch_time == 0) {
+                cnx->ack_cpu_epoch_time = current_time;
+                cnx->ack_cpu_epoch_thread_time = picoquic_thread_cpu_time();
+            }
+            else if (current_time > cnx->ack_cpu_epoch_time + cnx->path[0]->smoothed_rtt &&
+                current_time > cnx->ack_cpu_epoch_time + PICOQUIC_ACK_DELAY_MIN) {
+                uint64_t thread_time = picoquic_thread_cpu_time();
+                uint64_t cpu_load = 0;
+                int was_high = cnx->ack_cpu_load_permille > PICOQUIC_ADAPTIVE_ACK_CPU_LOAD_HIGH;
+
+                if (thread_time > cnx->ack_cpu_epoch_thread_time) {
+                    cpu_load = ((thread_time - cnx->ack_cpu_epoch_thread_time) * 1000) / (current_time - cnx->ack_cpu_epoch_time);
+                }
+                cnx->ack_cpu_load_permille = cpu_load;
+                cnx->ack_cpu_epoch_time = current_time;
+                cnx->ack_cpu_epoch_thread_time = thread_time;
+                if (was_high != (cpu_load > PICOQUIC_ADAPTIVE_ACK_CPU_LOAD_HIGH)) {
+                    cnx->is_ack_frequency_updated = 1;
+                }
+            }
+        }
+
+        if (picoquic_ack_frequency_reordering_threshold(cnx) != cnx->ack_reordering_threshold_local) {
+            cnx->is_ack_frequency_updated = 1;
+        }
+    }
+}
+
 void picoquic_compute_ack_gap_and_delay(picoquic_cnx_t* cnx, uint64_t rtt, uint64_t remote_min_ack_delay,
     uint64_t data_rate, uint64_t* ack_gap, uint64_t* ack_delay_max)
 {
@@ -2872,43 +4346,92 @@ void picoquic_compute_ack_gap_and_delay(picoquic_cnx_t* cnx, uint64_t rtt, uint6
     if (cnx->path[0]->rtt_min < *ack_delay_max * 4 && *ack_gap > 32) {
         *ack_gap = 32;
     }
+    if (cnx->is_ack_frequency_negotiated && cnx->quic->is_adaptive_ack_frequency_enabled) {
+        picoquic_adaptive_ack_gap(cnx, nb_packets, ack_gap);
+    }
 }
 
 /* In a multipath environment, a packet can carry acknowledgements for multiple paths.
  * The packet_data context collects information about updates received for each of
- * these paths. */
+ * these paths. Returns NULL if the entry cannot be allocated. */
+static picoquic_path_ack_data_t* picoquic_packet_data_find_or_add(picoquic_packet_data_t* packet_data,
+    picoquic_path_t* acked_path, int* is_new)
+{
+    picoquic_path_ack_data_t* path_ack = NULL;
+    int path_i = 0;
+
+    *is_new = 0;
+    while (path_i < packet_data->nb_path_ack &&
+        PICOQUIC_PACKET_DATA_PATH_ACK(packet_data, path_i)->acked_path != acked_path) {
+        path_i++;
+    }
+    if (path_i < packet_data->nb_path_ack) {
+        path_ack = PICOQUIC_PACKET_DATA_PATH_ACK(packet_data, path_i);
+    }
+    else {
+        if (path_i >= PICOQUIC_PACKET_DATA_INLINE_PATHS &&
+            path_i - PICOQUIC_PACKET_DATA_INLINE_PATHS >= packet_data->nb_path_ack_more_alloc) {
+            int new_alloc = (packet_data->nb_path_ack_more_alloc == 0) ? PICOQUIC_PACKET_DATA_INLINE_PATHS :
+                2 * packet_data->nb_path_ack_more_alloc;
+            picoquic_path_ack_data_t* new_more = (picoquic_path_ack_data_t*)malloc(new_alloc * sizeof(picoquic_path_ack_data_t));
+
+            if (new_more != NULL) {
+                if (packet_data->path_ack_more != NULL) {
+                    memcpy(new_more, packet_data->path_ack_more, packet_data->nb_path_ack_more_alloc * sizeof(picoquic_path_ack_data_t));
+                    free(packet_data->path_ack_more);
+                }
+                packet_data->path_ack_more = new_more;
+                packet_data->nb_path_ack_more_alloc = new_alloc;
+            }
+        }
+        if (path_i < PICOQUIC_PACKET_DATA_INLINE_PATHS ||
+            path_i - PICOQUIC_PACKET_DATA_INLINE_PATHS < packet_data->nb_path_ack_more_alloc) {
+            path_ack = PICOQUIC_PACKET_DATA_PATH_ACK(packet_data, path_i);
+            memset(path_ack, 0, sizeof(picoquic_path_ack_data_t));
+            path_ack->acked_path = acked_path;
+            packet_data->nb_path_ack++;
+            *is_new = 1;
+        }
+    }
+
+    return path_ack;
+}
+
+void picoquic_packet_data_release(picoquic_packet_data_t* packet_data)
+{
+    if (packet_data->path_ack_more != NULL) {
+        free(packet_data->path_ack_more);
+    }
+    memset(packet_data, 0, sizeof(picoquic_packet_data_t));
+}
+
 void picoquic_record_ack_packet_data(picoquic_packet_data_t* packet_data, picoquic_packet_t* acked_packet)
 {
     picoquic_path_t* old_path = acked_packet->send_path;
 
     if (old_path != NULL) {
-        /* Find the path index in the packet data structure */
-        int path_i = 0;
-        while (path_i < packet_data->nb_path_ack &&
-            packet_data->path_ack[path_i].acked_path != old_path) {
-            path_i++;
+        int is_new;
+        picoquic_path_ack_data_t* path_ack = picoquic_packet_data_find_or_add(packet_data, old_path, &is_new);
+
+        if (path_ack == NULL) {
+            /* Cannot allocate memory -- do not update path status. */
+            return;
         }
-        if (path_i == packet_data->nb_path_ack) {
-            if (path_i > PICOQUIC_NB_PATH_TARGET) {
-                /* Too many ACKs in this packet -- do not update path status. */
-                return;
-            }
-            packet_data->nb_path_ack++;
-            packet_data->path_ack[path_i].acked_path = old_path;
+        if (!path_ack->is_set) {
+            path_ack->largest_sent_time = acked_packet->send_time;
+            path_ack->delivered_prior = acked_packet->delivered_prior;
+            path_ack->delivered_time_prior = acked_packet->delivered_time_prior;
+            path_ack->delivered_sent_prior = acked_packet->delivered_sent_prior;
+            path_ack->lost_prior = acked_packet->lost_prior;
+            path_ack->inflight_prior = acked_packet->inflight_prior;
+            path_ack->rs_is_path_limited = acked_packet->delivered_app_limited;
+            path_ack->rs_is_cwnd_limited = acked_packet->sent_cwin_limited;
+            path_ack->is_set = 1;
         }
-
-        if (!packet_data->path_ack[path_i].is_set) {
-            packet_data->path_ack[path_i].largest_sent_time = acked_packet->send_time;
-            packet_data->path_ack[path_i].delivered_prior = acked_packet->delivered_prior;
-            packet_data->path_ack[path_i].delivered_time_prior = acked_packet->delivered_time_prior;
-            packet_data->path_ack[path_i].delivered_sent_prior = acked_packet->delivered_sent_prior;
-            packet_data->path_ack[path_i].lost_prior = acked_packet->lost_prior;
-            packet_data->path_ack[path_i].inflight_prior = acked_packet->inflight_prior;
-            packet_data->path_ack[path_i].rs_is_path_limited = acked_packet->delivered_app_limited;
-            packet_data->path_ack[path_i].rs_is_cwnd_limited = acked_packet->sent_cwin_limited;
-            packet_data->path_ack[path_i].is_set = 1;
+        path_ack->data_acked += PICOQUIC_PACKET_SENT_LENGTH(acked_packet);
+        if (acked_packet->is_ce_marked) {
+            path_ack->data_ce_marked += PICOQUIC_PACKET_SENT_LENGTH(acked_packet);
         }
-        packet_data->path_ack[path_i].data_acked += acked_packet->length;
     }
 }
 
@@ -2920,19 +4443,20 @@ void process_decoded_packet_data(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
     int epoch, uint64_t current_time, picoquic_packet_data_t* packet_data)
 {
     for (int i = 0; i < packet_data->nb_path_ack; i++) {
+        picoquic_path_ack_data_t* path_ack = PICOQUIC_PACKET_DATA_PATH_ACK(packet_data, i);
         uint64_t lost_before_ack = path_x->total_bytes_lost;
         uint64_t nb_bytes_newly_lost = 0;
 
-        picoquic_update_path_rtt(cnx, packet_data->path_ack[i].acked_path, path_x, epoch,
-            packet_data->path_ack[i].largest_sent_time, current_time, packet_data->last_ack_delay,
+        picoquic_update_path_rtt(cnx, path_ack->acked_path, path_x, epoch,
+            path_ack->largest_sent_time, current_time, packet_data->last_ack_delay,
             packet_data->last_time_stamp_received);
 
-        picoquic_estimate_path_bandwidth(cnx, packet_data->path_ack[i].acked_path, packet_data->path_ack[i].largest_sent_time,
-            packet_data->path_ack[i].delivered_prior, packet_data->path_ack[i].delivered_time_prior, packet_data->path_ack[i].delivered_sent_prior,
+        picoquic_estimate_path_bandwidth(cnx, path_ack->acked_path, path_ack->largest_sent_time,
+            path_ack->delivered_prior, path_ack->delivered_time_prior, path_ack->delivered_sent_prior,
             (packet_data->last_time_stamp_received == 0) ? current_time : packet_data->last_time_stamp_received,
-            current_time, packet_data->path_ack[i].rs_is_path_limited);
+            current_time, path_ack->rs_is_path_limited);
 
-        picoquic_estimate_max_path_bandwidth(cnx, packet_data->path_ack[i].acked_path, packet_data->path_ack[i].largest_sent_time,
+        picoquic_estimate_max_path_bandwidth(cnx, path_ack->acked_path, path_ack->largest_sent_time,
             (packet_data->last_time_stamp_received == 0) ? current_time : packet_data->last_time_stamp_received,
             current_time);
 
@@ -2940,14 +4464,15 @@ void process_decoded_packet_data(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
             picoquic_queue_retransmit_on_ack(cnx, path_x, current_time);
             nb_bytes_newly_lost = path_x->total_bytes_lost - lost_before_ack;
         }
-        if (cnx->congestion_alg != NULL && packet_data->path_ack[i].acked_path->rtt_sample > 0) {
+        if (cnx->congestion_alg != NULL && path_ack->acked_path->rtt_sample > 0) {
             picoquic_per_ack_state_t ack_state = { 0 };
-            ack_state.rtt_measurement = packet_data->path_ack[i].acked_path->rtt_sample;
-            ack_state.one_way_delay = packet_data->path_ack[i].acked_path->one_way_delay_sample;
-            ack_state.nb_bytes_acknowledged = packet_data->path_ack[i].data_acked;
+            ack_state.rtt_measurement = path_ack->acked_path->rtt_sample;
+            ack_state.one_way_delay = path_ack->acked_path->one_way_delay_sample;
+            ack_state.nb_bytes_acknowledged = path_ack->data_acked;
+            ack_state.nb_bytes_ce_marked = path_ack->data_ce_marked;
             ack_state.nb_bytes_newly_lost = nb_bytes_newly_lost;
             if (cnx->cnx_state == picoquic_state_ready) {
-                ack_state.nb_bytes_lost_since_packet_sent = path_x->total_bytes_lost - packet_data->path_ack[i].lost_prior;
+                ack_state.nb_bytes_lost_since_packet_sent = path_x->total_bytes_lost - path_ack->lost_prior;
             }
             else {
                 /* the count of lost bytes is very unreliable before the handshake completes.
@@ -2957,14 +4482,15 @@ void process_decoded_packet_data(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
                  */
                 ack_state.nb_bytes_lost_since_packet_sent = nb_bytes_newly_lost;
             }
-            ack_state.nb_bytes_delivered_since_packet_sent = path_x->delivered - packet_data->path_ack[i].delivered_prior;
-            ack_state.inflight_prior = packet_data->path_ack[i].inflight_prior;
-            ack_state.is_app_limited = packet_data->path_ack[i].rs_is_path_limited;
-            ack_state.is_cwnd_limited = packet_data->path_ack[i].rs_is_cwnd_limited;
-            packet_data->path_ack[i].acked_path->is_lost_feedback_notified = 0;
-            cnx->congestion_alg->alg_notify(cnx, packet_data->path_ack[i].acked_path,
+            ack_state.nb_bytes_delivered_since_packet_sent = path_x->delivered - path_ack->delivered_prior;
+            ack_state.inflight_prior = path_ack->inflight_prior;
+            ack_state.is_app_limited = path_ack->rs_is_path_limited;
+            ack_state.is_cwnd_limited = path_ack->rs_is_cwnd_limited;
+            path_ack->acked_path->is_lost_feedback_notified = 0;
+            cnx->congestion_alg->alg_notify(cnx, path_ack->acked_path,
                 picoquic_congestion_notification_acknowledgement,
                 &ack_state, current_time);
+            PICOQUIC_PROBE_CC_NOTIFY(cnx, path_ack->acked_path, picoquic_congestion_notification_acknowledgement);
         }
     }
 
@@ -2973,6 +4499,101 @@ void process_decoded_packet_data(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
     }
 }
 
+/* When a receive batch is open, the ACK data of successive packets is merged in
+ * the connection context, and processed once at the end of the batch. The congestion
+ * control algorithm then receives one rate sample per path instead of one per packet,
+ * which matters when ACKs are compressed or coalesced by GRO. The sample of each path
+ * is taken from the newest acknowledged packet, and the acknowledged bytes add up.
+ */
+static void picoquic_ack_batch_merge(picoquic_packet_data_t* batch, picoquic_packet_data_t* packet_data)
+{
+    int is_newer = 0;
+
+    for (int j = 0; j < packet_data->nb_path_ack; j++) {
+        picoquic_path_ack_data_t* path_ack = PICOQUIC_PACKET_DATA_PATH_ACK(packet_data, j);
+        int is_new;
+        picoquic_path_ack_data_t* batch_ack = picoquic_packet_data_find_or_add(batch, path_ack->acked_path, &is_new);
+
+        if (batch_ack == NULL) {
+            /* Cannot allocate memory -- do not update path status. */
+            continue;
+        }
+        else if (is_new) {
+            *batch_ack = *path_ack;
+            is_newer = 1;
+        }
+        else {
+            uint64_t data_acked = batch_ack->data_acked + path_ack->data_acked;
+
+            if (path_ack->largest_sent_time >= batch_ack->largest_sent_time) {
+                *batch_ack = *path_ack;
+                is_newer = 1;
+            }
+            batch_ack->data_acked = data_acked;
+        }
+    }
+    if (is_newer) {
+        /* The ACK delay must match the largest sent time used for the RTT sample */
+        batch->last_time_stamp_received = packet_data->last_time_stamp_received;
+        batch->last_ack_delay = packet_data->last_ack_delay;
+    }
+}
+
+void picoquic_ack_batch_add(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int epoch,
+    uint64_t current_time, picoquic_packet_data_t* packet_data)
+{
+    if (!cnx->quic->is_receive_batch_open || packet_data->nb_path_ack == 0) {
+        process_decoded_packet_data(cnx, path_x, epoch, current_time, packet_data);
+    }
+    else {
+        if (cnx->ack_batch.nb_path_ack > 0 &&
+            (cnx->ack_batch_path != path_x || cnx->ack_batch_epoch != epoch)) {
+            /* Samples are only aggregated if received on the same path and epoch */
+            picoquic_ack_batch_flush(cnx);
+        }
+        if (cnx->ack_batch.nb_path_ack == 0) {
+            cnx->ack_batch_path = path_x;
+            cnx->ack_batch_epoch = epoch;
+        }
+        picoquic_ack_batch_merge(&cnx->ack_batch, packet_data);
+        cnx->ack_batch_time = current_time;
+
+        if (!cnx->is_ack_batch_queued) {
+            cnx->ack_batch_next = cnx->quic->ack_batch_first;
+            cnx->quic->ack_batch_first = cnx;
+            cnx->is_ack_batch_queued = 1;
+        }
+    }
+}
+
+void picoquic_ack_batch_flush(picoquic_cnx_t* cnx)
+{
+    if (cnx->ack_batch.nb_path_ack > 0) {
+        process_decoded_packet_data(cnx, cnx->ack_batch_path, cnx->ack_batch_epoch,
+            cnx->ack_batch_time, &cnx->ack_batch);
+        picoquic_packet_data_release(&cnx->ack_batch);
+    }
+}
+
+/* Remove the connection from the list of pending batches, dropping the
+ * pending data. Used when the connection is deleted. */
+void picoquic_ack_batch_forget_cnx(picoquic_cnx_t* cnx)
+{
+    if (cnx->is_ack_batch_queued) {
+        picoquic_cnx_t** pprevious = &cnx->quic->ack_batch_first;
+
+        while (*pprevious != NULL && *pprevious != cnx) {
+            pprevious = &(*pprevious)->ack_batch_next;
+        }
+        if (*pprevious != NULL) {
+            *pprevious = cnx->ack_batch_next;
+        }
+        cnx->ack_batch_next = NULL;
+        cnx->is_ack_batch_queued = 0;
+    }
+    picoquic_packet_data_release(&cnx->ack_batch);
+}
+
 static picoquic_packet_t* picoquic_find_acked_packet(picoquic_cnx_t* cnx, picoquic_packet_context_t* pkt_ctx,
     uint64_t largest, uint64_t current_time, int* is_new_ack)
 {
@@ -2986,8 +4607,11 @@ static picoquic_packet_t* picoquic_find_acked_packet(picoquic_cnx_t* cnx, picoqu
         pkt_ctx->ack_of_ack_requested = 0;
         *is_new_ack = 1;
 
-        while (packet != NULL && packet->packet_next != NULL && packet->sequence_number < largest) {
-            packet = packet->packet_next;
+        if ((packet = picoquic_packet_index_find(&pkt_ctx->pending_index, largest)) == NULL) {
+            packet = pkt_ctx->pending_first;
+            while (packet != NULL && packet->packet_next != NULL && packet->sequence_number < largest) {
+                packet = packet->packet_next;
+            }
         }
     }
 
@@ -3127,7 +4751,7 @@ int picoquic_process_ack_of_path_ack_frame(
 
     if (ret == 0) {
         picoquic_ack_context_t* ack_ctx = NULL;
-        if (cnx->is_multipath_enabled) {
+        if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
             int path_index = picoquic_find_path_by_unique_id(cnx, path_id);
             if (path_index >= 0) {
                 ack_ctx = &cnx->path[path_index]->ack_ctx;
@@ -3188,8 +4812,15 @@ int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
                     *no_need_to_repeat = picoquic_check_sack_list(&stream->sack_list, offset, offset + data_length - ((fin) ? 0 : 1));
                 }
 
-                if (is_preemptive_needed != NULL && stream->fin_sent) {
-                    *is_preemptive_needed |= 1;
+                if (is_preemptive_needed != NULL) {
+                    if (stream->fin_sent) {
+                        *is_preemptive_needed |= PICOQUIC_PREEMPTIVE_STREAM_FIN;
+                    }
+                    else if (stream->send_queue == NULL && offset + data_length >= stream->sent_offset) {
+                        /* Nothing more queued after this frame: a loss would only be
+                         * detected after a timer. */
+                        *is_preemptive_needed |= PICOQUIC_PREEMPTIVE_MESSAGE_TAIL;
+                    }
                 }
             }
         }
@@ -3317,6 +4948,9 @@ int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
             if (cnx->is_handshake_done_acked) {
                 *no_need_to_repeat = 1;
             }
+            else if (is_preemptive_needed != NULL) {
+                *is_preemptive_needed |= PICOQUIC_PREEMPTIVE_HANDSHAKE_TAIL;
+            }
             break;
         case picoquic_frame_type_new_token:
             /* No need to retransmit if one was previously acked */
@@ -3326,6 +4960,9 @@ int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
             break;
         case picoquic_frame_type_crypto_hs:
             ret = picoquic_check_crypto_frame_needs_repeat(cnx, bytes, bytes_max, p_type, no_need_to_repeat);
+            if (ret == 0 && !*no_need_to_repeat && is_preemptive_needed != NULL) {
+                *is_preemptive_needed |= PICOQUIC_PREEMPTIVE_HANDSHAKE_TAIL;
+            }
             break;
         case picoquic_frame_type_new_connection_id:
             ret = picoquic_check_new_cid_needs_repeat(cnx, bytes, bytes_max, 0, no_need_to_repeat);
@@ -3369,6 +5006,18 @@ int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
                 case picoquic_frame_type_time_stamp:
                     *no_need_to_repeat = 1;
                     break;
+                case picoquic_frame_type_stream_metadata:
+                    if (picoquic_parse_stream_metadata_frame(type_bytes, p_bytes_max,
+                        &stream_id, &offset, &data_length, &fin) == NULL) {
+                        ret = -1;
+                    }
+                    else if ((stream = picoquic_find_stream(cnx, stream_id)) == NULL || stream->reset_sent) {
+                        *no_need_to_repeat = 1;
+                    }
+                    else {
+                        *no_need_to_repeat = picoquic_check_sack_list(&stream->sack_list, offset, offset + data_length - ((fin) ? 0 : 1));
+                    }
+                    break;
                 case picoquic_frame_type_path_abandon:
                     /* TODO: check whether there is still a need to abandon the path */
                     *no_need_to_repeat = 0;
@@ -3436,6 +5085,44 @@ int picoquic_process_ack_of_stream_frame(picoquic_cnx_t* cnx, uint8_t* bytes,
         if (stream != NULL) {
             (void)picoquic_update_sack_list(&stream->sack_list,
                 offset, offset + data_length - ((fin) ? 0 : 1), 0);
+            if (stream->first_retained != NULL) {
+                picoquic_stream_release_acked_data(cnx, stream);
+            }
+
+            picoquic_delete_stream_if_closed(cnx, stream);
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_process_ack_of_stream_metadata_frame(picoquic_cnx_t* cnx, const uint8_t* bytes,
+    size_t bytes_max, size_t* consumed)
+{
+    int ret = 0;
+    int fin;
+    size_t data_length;
+    uint64_t stream_id;
+    uint64_t offset;
+    picoquic_stream_head_t* stream = NULL;
+    const uint8_t* bytes_next = picoquic_parse_stream_metadata_frame(bytes, bytes + bytes_max,
+        &stream_id, &offset, &data_length, &fin);
+
+    if (bytes_next == NULL) {
+        *consumed = bytes_max;
+        ret = -1;
+    }
+    else {
+        *consumed = bytes_next - bytes;
+
+        /* record the ack range for the stream, as for the stripped stream frame */
+        stream = picoquic_find_stream(cnx, stream_id);
+        if (stream != NULL) {
+            (void)picoquic_update_sack_list(&stream->sack_list,
+                offset, offset + data_length - ((fin) ? 0 : 1), 0);
+            if (stream->first_retained != NULL) {
+                picoquic_stream_release_acked_data(cnx, stream);
+            }
 
             picoquic_delete_stream_if_closed(cnx, stream);
         }
@@ -3551,6 +5238,13 @@ void picoquic_process_ack_of_frames(picoquic_cnx_t* cnx, picoquic_packet_t* p,
             ret = picoquic_process_ack_of_observed_address_frame(cnx, p->send_path, &p->bytes[byte_index], p->length - byte_index, ftype, &frame_length);
             byte_index += frame_length;
             break;
+        case picoquic_frame_type_stream_metadata:
+            ret = picoquic_process_ack_of_stream_metadata_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
+            byte_index += frame_length;
+            if (p->send_path != NULL && p->send_time > p->send_path->last_time_acked_data_frame_sent) {
+                p->send_path->last_time_acked_data_frame_sent = p->send_time;
+            }
+            break;
         default:
             if (PICOQUIC_IN_RANGE(ftype, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
                 ret = picoquic_process_ack_of_stream_frame(cnx, &p->bytes[byte_index], p->length - byte_index, &frame_length);
@@ -3590,10 +5284,19 @@ void picoquic_process_ack_of_frames(picoquic_cnx_t* cnx, picoquic_packet_t* p,
     }
 }
 
+/* Attribution of CE marks to acknowledged packets.
+ * The ECN counts in the ACK_ECN frame only tell how many packets were
+ * marked since the previous ACK, not which ones. The new marks are
+ * attributed to the packets newly acknowledged by the frame, starting with
+ * the most recent one, which reflects the latest state of the queue. This
+ * lets congestion control compute the marked fraction in bytes.
+ * Marks that exceed the number of newly acknowledged packets, for example
+ * marks on ACK only packets that are not tracked, are not attributed.
+ */
 static int picoquic_process_ack_range(
     picoquic_cnx_t* cnx, picoquic_packet_context_enum pc, picoquic_packet_context_t * pkt_ctx,
     uint64_t highest, uint64_t range, picoquic_packet_t** ppacket,
-    uint64_t current_time, picoquic_packet_data_t* packet_data)
+    uint64_t current_time, picoquic_packet_data_t* packet_data, uint64_t * ce_to_attribute)
 {
     picoquic_packet_t* p = *ppacket;
     int ret = 0;
@@ -3601,7 +5304,16 @@ static int picoquic_process_ack_range(
     /* Compare the range to the retransmit queue */
     while (p != NULL && range > 0) {
         if (p->sequence_number > highest) {
-            p = p->packet_previous;
+            picoquic_packet_t* p_highest = picoquic_packet_index_find(&pkt_ctx->pending_index, highest);
+            p = (p_highest != NULL) ? p_highest : p->packet_previous;
+        } else if (p->sequence_number < highest) {
+            /* The numbers above this packet were already acknowledged, skip them */
+            uint64_t delta = highest - p->sequence_number;
+            if (delta >= range) {
+                break;
+            }
+            range -= delta;
+            highest -= delta;
         } else {
             if (p->sequence_number == highest) {
                 picoquic_packet_t* next = p->packet_previous;
@@ -3613,7 +5325,7 @@ static int picoquic_process_ack_range(
                 }
 
                 if (old_path != NULL) {
-                    old_path->delivered += p->length;
+                    old_path->delivered += PICOQUIC_PACKET_SENT_LENGTH(p);
                     /* Reset the flags tracking loss of ack only packets and corresponding ping */
                     old_path->is_ack_lost = 0;
                     old_path->is_ack_expected = 0;
@@ -3621,14 +5333,24 @@ static int picoquic_process_ack_range(
                     if (p->sequence_number >= picoquic_get_ack_number(cnx, old_path, pc)) {
                         old_path->nb_retransmit = 0;
                     }
+                    if (*ce_to_attribute > 0) {
+                        p->is_ce_marked = 1;
+                        old_path->nb_ce_marked_packets++;
+                        old_path->ce_marked_bytes += PICOQUIC_PACKET_SENT_LENGTH(p);
+                        *ce_to_attribute -= 1;
+                    }
 
                     picoquic_record_ack_packet_data(packet_data, p);
                     /* If packet is larger than the current MTU, update the MTU */
-                    if ((p->length + p->checksum_overhead) == old_path->send_mtu) {
+                    if ((PICOQUIC_PACKET_SENT_LENGTH(p) + p->checksum_overhead) == old_path->send_mtu) {
                         old_path->nb_mtu_losses = 0;
-                    } else if ((p->length + p->checksum_overhead) > old_path->send_mtu) {
-                        old_path->send_mtu = p->length + p->checksum_overhead;
+                    } else if ((PICOQUIC_PACKET_SENT_LENGTH(p) + p->checksum_overhead) > old_path->send_mtu) {
+                        old_path->send_mtu = PICOQUIC_PACKET_SENT_LENGTH(p) + p->checksum_overhead;
                         old_path->mtu_probe_sent = 0;
+                        if (p->is_mtu_probe) {
+                            picoquic_pmtu_cache_save(cnx->quic, (struct sockaddr*)&old_path->first_tuple->peer_addr,
+                                old_path->send_mtu, current_time);
+                        }
                     }
                 }
 
@@ -3673,6 +5395,7 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
         ((is_ecn) ? picoquic_frame_type_ack_ecn : picoquic_frame_type_ack);
     picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[pc];
     uint64_t largest_in_path = 0;
+    uint64_t ce_to_attribute = 0;
     picoquic_path_t * ack_path = cnx->path[0];
 
     if (picoquic_parse_ack_header(bytes, bytes_max-bytes, &num_block,
@@ -3682,13 +5405,13 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
         bytes = NULL;
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, ftype);
     }
-    else if (has_path_id && !cnx->is_multipath_enabled) {
+    else if (has_path_id && !PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         bytes = NULL;
         picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, ftype);
     }
     else {
         if (pc == picoquic_packet_context_application) {
-            if (cnx->is_multipath_enabled) {
+            if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                 int path_index = picoquic_find_path_by_unique_id(cnx, path_id);
                 if (path_index < 0) {
                     /* No such path ID. Ignore frame. TODO: error if never seen? */
@@ -3706,6 +5429,19 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
             picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, ftype);
         }
         else {
+            if (is_ecn) {
+                /* Peek at the ECN counts at the end of the frame, so CE marks can
+                 * be attributed while processing the acknowledged packets. */
+                uint64_t ecn_peek[3] = { 0, 0, 0 };
+                const uint8_t* bytes_ecn = picoquic_skip_ack_frame_maybe_ecn(bytes, bytes_max, 0, has_path_id);
+
+                for (int ecnx = 0; bytes_ecn != NULL && ecnx < 3; ecnx++) {
+                    bytes_ecn = picoquic_frames_varint_decode(bytes_ecn, bytes_max, &ecn_peek[ecnx]);
+                }
+                if (bytes_ecn != NULL && ecn_peek[2] > pkt_ctx->ecn_ce_total_remote) {
+                    ce_to_attribute = ecn_peek[2] - pkt_ctx->ecn_ce_total_remote;
+                }
+            }
             bytes += consumed;
 
             /* Attempt to update the RTT */
@@ -3727,16 +5463,16 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
                 }
             }
 
-            do {
-                uint64_t range;
-                uint64_t block_to_block;
+            uint64_t range;
 
-                if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range)) == NULL) {
-                    DBG_PRINTF("Malformed ACK RANGE, %d blocks remain.\n", (int)num_block);
-                    picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, ftype);
-                    bytes = NULL;
-                    break;
-                }
+            if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range)) == NULL) {
+                DBG_PRINTF("Malformed ACK RANGE, %d blocks remain.\n", (int)num_block);
+                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, ftype);
+            }
+
+            while (bytes != NULL) {
+                uint64_t gap_and_range[2];
+                uint64_t block_to_block;
 
                 range++;
                 if (largest + 1 < range) {
@@ -3746,7 +5482,7 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
                     break;
                 }
 
-                if (picoquic_process_ack_range(cnx, pc, pkt_ctx, largest, range, &top_packet, current_time, packet_data) != 0) {
+                if (picoquic_process_ack_range(cnx, pc, pkt_ctx, largest, range, &top_packet, current_time, packet_data, &ce_to_attribute) != 0) {
                     bytes = NULL;
                     break;
                 }
@@ -3759,14 +5495,14 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
                 if (num_block-- == 0)
                     break;
 
-                /* Skip the gap */
-                if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &block_to_block)) == NULL) {
-                    DBG_PRINTF("    Malformed ACK GAP, %d blocks remain.\n", (int)num_block);
+                /* Skip the gap, and decode the next range */
+                if ((bytes = picoquic_frames_varint_decode_batch(bytes, bytes_max, gap_and_range, 2)) == NULL) {
+                    DBG_PRINTF("    Malformed ACK GAP or RANGE, %d blocks remain.\n", (int)num_block);
                     picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_FRAME_FORMAT_ERROR, ftype);
-                    bytes = NULL;
                     break;
                 }
 
+                block_to_block = gap_and_range[0];
                 block_to_block += 1; /* add 1, since zero is ruled out by varint, see spec. */
                 block_to_block += range;
 
@@ -3779,9 +5515,12 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
                 }
 
                 largest -= block_to_block;
-            } while (bytes != NULL);
+                range = gap_and_range[1];
+            }
 
             picoquic_dequeue_old_retransmitted_packets(cnx, pkt_ctx);
+            /* The acknowledgement may change the loss status of the queued packets */
+            pkt_ctx->loss_check_time = 0;
         }
     }
 
@@ -3805,6 +5544,7 @@ const uint8_t* picoquic_decode_ack_frame(picoquic_cnx_t* cnx, const uint8_t* byt
             cnx->congestion_alg->alg_notify(cnx, ack_path,
                 picoquic_congestion_notification_ecn_ec,
                 &ack_state, current_time);
+            PICOQUIC_PROBE_CC_NOTIFY(cnx, ack_path, picoquic_congestion_notification_ecn_ec);
         }
     }
 
@@ -3830,7 +5570,7 @@ uint8_t* picoquic_format_ack_frame_in_context(picoquic_cnx_t* cnx, uint8_t* byte
     /* Check that there something to acknowledge */
     int not_needed = picoquic_sack_list_is_empty(&ack_ctx->sack_list);
     if (!not_needed && !ack_ctx->act[is_opportunistic].ack_needed &&
-        ack_ctx->sack_list.ack_tree.size == 1) {
+        picoquic_sack_list_size(&ack_ctx->sack_list) == 1) {
         picoquic_sack_item_t* last_sack = picoquic_sack_last_item(&ack_ctx->sack_list);
         not_needed = (last_sack->nb_times_sent[is_opportunistic] >= PICOQUIC_MAX_ACK_RANGE_REPEAT);
     }
@@ -3869,7 +5609,9 @@ uint8_t* picoquic_format_ack_frame_in_context(picoquic_cnx_t* cnx, uint8_t* byte
             /* Implement adaptive tuning of lowest repeat range */
             int nb_sent_max_acked = 0;
             int nb_sent_max_skip = 0;
-            picoquic_sack_item_t* next_sack = picoquic_sack_previous_item(last_sack);
+            int nb_scanned = 0;
+            uint64_t new_floor = UINT64_MAX;
+            picoquic_sack_item_t* next_sack = picoquic_sack_previous_item(&ack_ctx->sack_list, last_sack);
 
             /* Update send count for the top range */
             picoquic_sack_item_record_sent(&ack_ctx->sack_list, last_sack, is_opportunistic);
@@ -3879,11 +5621,23 @@ uint8_t* picoquic_format_ack_frame_in_context(picoquic_cnx_t* cnx, uint8_t* byte
              */
             picoquic_sack_select_ack_ranges(&ack_ctx->sack_list, last_sack, 32, 
                 is_opportunistic, &nb_sent_max_acked, &nb_sent_max_skip);
+            /* Do not skip more candidate ranges than the scan limit allows */
+            if (nb_sent_max_skip > PICOQUIC_MAX_ACK_RANGE_SCAN - 32) {
+                nb_sent_max_skip = PICOQUIC_MAX_ACK_RANGE_SCAN - 32;
+            }
 
             /* Set the lowest acknowledged */
             lowest_acknowledged = picoquic_sack_item_range_start(last_sack);
-            while (num_block < 32 && next_sack != NULL) {
+            /* Ranges below the scan floor have all been repeated enough and will
+             * not be selected, so the scan stops there. When packets arrive in
+             * order, this leaves only the top range to encode. The number of
+             * candidate ranges examined is also bounded, so that connections
+             * with hundreds of live ranges do not skip or encode through the
+             * whole list at every ACK. */
+            while (num_block < 32 && next_sack != NULL && nb_scanned < PICOQUIC_MAX_ACK_RANGE_SCAN &&
+                picoquic_sack_item_range_end(next_sack) >= ack_ctx->sack_list.ack_scan_floor[is_opportunistic]) {
                 if (picoquic_sack_item_nb_times_sent(next_sack, is_opportunistic) <= nb_sent_max_acked) {
+                    nb_scanned++;
                     if (picoquic_sack_item_nb_times_sent(next_sack, is_opportunistic) == nb_sent_max_acked &&
                         nb_sent_max_skip > 0) {
                         nb_sent_max_skip--;
@@ -3906,7 +5660,21 @@ uint8_t* picoquic_format_ack_frame_in_context(picoquic_cnx_t* cnx, uint8_t* byte
                         }
                     }
                 }
-                next_sack = picoquic_sack_previous_item(next_sack);
+                if (picoquic_sack_item_nb_times_sent(next_sack, is_opportunistic) > PICOQUIC_MAX_ACK_RANGE_REPEAT) {
+                    if (new_floor == UINT64_MAX) {
+                        new_floor = picoquic_sack_item_range_end(next_sack) + 1;
+                    }
+                }
+                else {
+                    new_floor = UINT64_MAX;
+                }
+                next_sack = picoquic_sack_previous_item(&ack_ctx->sack_list, next_sack);
+            }
+            /* If the scan reached the floor, the retired ranges found just above it
+             * can be skipped from now on. */
+            if (new_floor != UINT64_MAX && (next_sack == NULL ||
+                picoquic_sack_item_range_end(next_sack) < ack_ctx->sack_list.ack_scan_floor[is_opportunistic])) {
+                ack_ctx->sack_list.ack_scan_floor[is_opportunistic] = new_floor;
             }
             /* When numbers are lower than 64, varint encoding fits on one byte */
             *num_block_byte = (uint8_t)num_block;
@@ -3962,7 +5730,7 @@ uint8_t * picoquic_format_ack_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t
     int need_time_stamp = (pc == picoquic_packet_context_application && cnx->is_time_stamp_sent);
     picoquic_ack_context_t* ack_ctx = NULL;
 
-    if (cnx->is_multipath_enabled && pc == picoquic_packet_context_application) {
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx) && pc == picoquic_packet_context_application) {
         int ack_still_needed = 0;
         int ack_after_fin = 0;
         for (int path_id = 0; path_id < cnx->nb_paths; path_id++) {
@@ -3971,7 +5739,7 @@ uint8_t * picoquic_format_ack_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t
                 /* Adding test to verify that we do not send too many acks after demotion. */
                 if (cnx->path[path_id]->path_is_demoted &&
                     !ack_ctx->act[is_opportunistic].ack_needed &&
-                    ack_ctx->sack_list.ack_tree.size == 1) {
+                    picoquic_sack_list_size(&ack_ctx->sack_list) == 1) {
                     picoquic_sack_item_t* last_sack = picoquic_sack_last_item(&ack_ctx->sack_list);
                     if (last_sack->nb_times_sent[is_opportunistic] >= PICOQUIC_MIN_ACK_RANGE_REPEAT) {
                         continue;
@@ -4009,7 +5777,7 @@ void picoquic_set_ack_needed(picoquic_cnx_t* cnx, uint64_t current_time, picoqui
     picoquic_path_t * path_x, int is_immediate_ack_required)
 {
     if (pc == picoquic_packet_context_application &&
-        cnx->is_multipath_enabled) {
+        PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* TODO: this code seems wrong */
         path_x->ack_ctx.act[0].is_immediate_ack_required |= is_immediate_ack_required;
         if (!path_x->ack_ctx.act[0].ack_needed) {
@@ -4031,7 +5799,7 @@ void picoquic_set_ack_needed(picoquic_cnx_t* cnx, uint64_t current_time, picoqui
 uint64_t picoquic_ack_gap_override_if_needed(picoquic_cnx_t* cnx, int path_index)
 {
     uint64_t ack_gap = cnx->ack_gap_remote;
-    if (cnx->is_multipath_enabled) {
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         if (!cnx->path[path_index]->path_is_demoted &&
             !cnx->path[path_index]->first_tuple->challenge_failed &&
             !cnx->path[path_index]->first_tuple->response_required &&
@@ -4100,7 +5868,7 @@ int picoquic_is_ack_needed(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t*
         pc, is_opportunistic);
 
     if (pc == picoquic_packet_context_application) {
-        if (cnx->is_multipath_enabled) {
+        if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
             for (int i = 0; ret == 0 && i < cnx->nb_paths; i++) {
                 ret |= picoquic_is_ack_needed_in_ctx(cnx, &cnx->path[i]->ack_ctx, current_time, i,
                     next_wake_time, pc, is_opportunistic);
@@ -4226,6 +5994,31 @@ uint8_t * picoquic_format_max_data_frame(picoquic_cnx_t* cnx, uint8_t * bytes, u
     return bytes;
 }
 
+/* Compute the increase of the connection flow control limit, or 0 if no
+ * update is needed. The increase is capped by the memory budget. */
+uint64_t picoquic_cnx_max_data_increase(picoquic_cnx_t* cnx)
+{
+    uint64_t max_data_increase = 0;
+
+    if (cnx->quic->max_data_limit != 0) {
+        if (cnx->data_received + ((3 * cnx->quic->max_data_limit) / 4) > cnx->maxdata_local) {
+            max_data_increase = cnx->data_received + cnx->quic->max_data_limit - cnx->maxdata_local;
+        }
+    }
+    else if (cnx->quic->rcv_window_max != 0 && cnx->rcv_autotune.window != 0) {
+        uint64_t new_limit = picoquic_rcv_autotune_new_limit(&cnx->rcv_autotune, cnx->data_received, cnx->maxdata_local);
+
+        if (new_limit > cnx->maxdata_local) {
+            max_data_increase = new_limit - cnx->maxdata_local;
+        }
+    }
+    else if (2 * cnx->data_received > cnx->maxdata_local) {
+        max_data_increase = picoquic_cc_increased_window(cnx, cnx->maxdata_local);
+    }
+    /* Do not give the peer more credit than the memory budget allows */
+    return picoquic_memory_budget_credit(cnx, max_data_increase);
+}
+
 const uint8_t* picoquic_decode_max_data_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     uint64_t maxdata;
@@ -4354,24 +6147,27 @@ uint8_t * picoquic_format_required_max_stream_data_frames(picoquic_cnx_t* cnx,
     uint8_t* bytes0;
     picoquic_stream_head_t* stream = picoquic_first_stream(cnx);
 
-    while (stream != NULL) {
-        if (!stream->fin_received) {
-            uint64_t new_window = picoquic_cc_increased_window(cnx, stream->maxdata_local);
+    /* Withhold the updates while the memory budget is exceeded */
+    if (!picoquic_memory_budget_exceeded(cnx)) {
+        while (stream != NULL) {
+            if (!stream->fin_received && !stream->reset_received) {
+                uint64_t new_max_data = picoquic_stream_new_max_data(cnx, stream);
 
-            if (!stream->reset_received && 2 * stream->consumed_offset > stream->maxdata_local) {
-                bytes0 = bytes;
+                if (new_max_data != 0) {
+                    bytes0 = bytes;
 
-                if ((bytes = picoquic_format_max_stream_data_frame(cnx, stream, bytes, bytes_max, more_data, is_pure_ack, stream->maxdata_local + new_window)) == bytes0) {
-                    /* not enough space for this frame. */
-                    break;
+                    if ((bytes = picoquic_format_max_stream_data_frame(cnx, stream, bytes, bytes_max, more_data, is_pure_ack, new_max_data)) == bytes0) {
+                        /* not enough space for this frame. */
+                        break;
+                    }
                 }
             }
+            stream = picoquic_next_stream(stream);
         }
-        stream = picoquic_next_stream(stream);
-    }
 
-    if (stream == NULL) {
-        cnx->max_stream_data_needed = 0;
+        if (stream == NULL) {
+            cnx->max_stream_data_needed = 0;
+        }
     }
 
     return bytes;
@@ -4381,15 +6177,67 @@ uint8_t * picoquic_format_required_max_stream_data_frames(picoquic_cnx_t* cnx,
  * Max stream ID frames
  */
 
+/* MAX_STREAMS autotuning. Measure how many remote streams complete during
+ * each RTT, and set the increment to twice that number, so the peer is not
+ * blocked waiting for credit while the MAX_STREAMS frame is in transit.
+ * The increment starts at the initial limit and never shrinks. It is capped
+ * by the configured maximum and by the number of stream contexts that fit
+ * in the connection memory budget.
+ */
+static void picoquic_streams_autotune_raise(picoquic_cnx_t* cnx, picoquic_streams_autotune_t* tune, uint64_t target)
+{
+    if (target > cnx->quic->max_streams_increment_max) {
+        target = cnx->quic->max_streams_increment_max;
+    }
+    if (cnx->memory_budget != 0 && target > cnx->memory_budget / sizeof(picoquic_stream_head_t)) {
+        target = cnx->memory_budget / sizeof(picoquic_stream_head_t);
+    }
+    if (target > tune->increment) {
+        tune->increment = target;
+    }
+}
+
+static void picoquic_streams_autotune_update(picoquic_cnx_t* cnx, picoquic_streams_autotune_t* tune,
+    uint64_t computed, uint64_t initial_max, uint64_t current_time)
+{
+    if (tune->epoch_time == 0) {
+        tune->epoch_time = current_time;
+        tune->epoch_computed = computed;
+        if (tune->increment < initial_max) {
+            tune->increment = initial_max;
+        }
+    }
+    else if (current_time >= tune->epoch_time + cnx->path[0]->smoothed_rtt) {
+        /* The computed values grow by 4 for each stream completed */
+        picoquic_streams_autotune_raise(cnx, tune, 2 * ((computed - tune->epoch_computed) / 4));
+        tune->epoch_time = current_time;
+        tune->epoch_computed = computed;
+    }
+}
+
+static uint64_t picoquic_max_streams_increment(picoquic_cnx_t* cnx, int is_unidir)
+{
+    uint64_t increment = (is_unidir) ? cnx->local_parameters.initial_max_stream_id_unidir :
+        cnx->local_parameters.initial_max_stream_id_bidir;
+
+    if (cnx->quic->max_streams_increment_max != 0 && cnx->streams_autotune[is_unidir].increment > increment) {
+        increment = cnx->streams_autotune[is_unidir].increment;
+    }
+
+    return increment;
+}
+
 uint8_t * picoquic_format_max_streams_frame_if_needed(picoquic_cnx_t* cnx,
     uint8_t* bytes, uint8_t * bytes_max, int * more_data, int * is_pure_ack)
 {
     uint8_t* bytes0 = bytes;
+    uint64_t bidir_increment = picoquic_max_streams_increment(cnx, 0);
+    uint64_t unidir_increment = picoquic_max_streams_increment(cnx, 1);
 
     if (cnx->max_stream_id_bidir_local_computed + 
-        2*cnx->local_parameters.initial_max_stream_id_bidir > cnx->max_stream_id_bidir_local) {
+        2*bidir_increment > cnx->max_stream_id_bidir_local) {
         uint64_t new_bidir_local = cnx->max_stream_id_bidir_local +
-            4 * cnx->local_parameters.initial_max_stream_id_bidir;
+            4 * bidir_increment;
         if ((bytes = picoquic_frames_uint8_encode(bytes, bytes_max, picoquic_frame_type_max_streams_bidir)) != NULL &&
             (bytes = picoquic_frames_varint_encode(bytes, bytes_max, STREAM_RANK_FROM_ID(new_bidir_local))) != NULL) {
             cnx->max_stream_id_bidir_local = new_bidir_local;
@@ -4402,8 +6250,8 @@ uint8_t * picoquic_format_max_streams_frame_if_needed(picoquic_cnx_t* cnx,
     }
     
     if (cnx->max_stream_id_unidir_local_computed +
-        2*cnx->local_parameters.initial_max_stream_id_unidir > cnx->max_stream_id_unidir_local) {
-        uint64_t new_unidir_local = cnx->max_stream_id_unidir_local + 4*cnx->local_parameters.initial_max_stream_id_unidir;
+        2*unidir_increment > cnx->max_stream_id_unidir_local) {
+        uint64_t new_unidir_local = cnx->max_stream_id_unidir_local + 4*unidir_increment;
 
         if ((bytes = picoquic_frames_uint8_encode(bytes, bytes_max, picoquic_frame_type_max_streams_unidir)) != NULL &&
             (bytes = picoquic_frames_varint_encode(bytes, bytes_max, STREAM_RANK_FROM_ID(new_unidir_local))) != NULL) {
@@ -4430,11 +6278,19 @@ void picoquic_update_max_stream_ID_local(picoquic_cnx_t* cnx, picoquic_stream_he
                 {
                     /* Sending is complete */
                     stream->max_stream_updated = 1;
+                    if (cnx->quic->max_streams_increment_max != 0) {
+                        picoquic_streams_autotune_update(cnx, &cnx->streams_autotune[0], cnx->max_stream_id_bidir_local_computed,
+                            cnx->local_parameters.initial_max_stream_id_bidir, picoquic_get_quic_time(cnx->quic));
+                    }
                     cnx->max_stream_id_bidir_local_computed += 4;
                 }
             } else {
                 /* No need to check receive complete on uni directional streams */
                 stream->max_stream_updated = 1;
+                if (cnx->quic->max_streams_increment_max != 0) {
+                    picoquic_streams_autotune_update(cnx, &cnx->streams_autotune[1], cnx->max_stream_id_unidir_local_computed,
+                        cnx->local_parameters.initial_max_stream_id_unidir, picoquic_get_quic_time(cnx->quic));
+                }
                 cnx->max_stream_id_unidir_local_computed += 4;
             }
         }
@@ -4544,7 +6400,7 @@ int picoquic_check_max_streams_frame_needs_repeat(picoquic_cnx_t* cnx, const uin
 /* Common code for datagrams and misc frames
  */
 
-uint8_t * picoquic_format_first_misc_or_dg_frame(uint8_t* bytes, uint8_t * bytes_max,
+uint8_t * picoquic_format_first_misc_or_dg_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t * bytes_max,
     int * more_data, int * is_pure_ack, picoquic_misc_frame_header_t* misc_frame,
     picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last)
 {
@@ -4555,7 +6411,7 @@ uint8_t * picoquic_format_first_misc_or_dg_frame(uint8_t* bytes, uint8_t * bytes
         memcpy(bytes, frame, misc_frame->length);
         bytes += misc_frame->length;
         *is_pure_ack &= misc_frame->is_pure_ack;
-        picoquic_delete_misc_or_dg(first, last, misc_frame);
+        picoquic_delete_misc_or_dg(cnx, first, last, misc_frame);
     }
 
     return bytes;
@@ -4586,7 +6442,7 @@ uint8_t* picoquic_format_misc_frames_in_context(picoquic_cnx_t* cnx, uint8_t* by
         uint8_t* bytes_misc = bytes;
         int frame_is_pure_ack = misc_frame->is_pure_ack;
 
-        bytes = picoquic_format_first_misc_or_dg_frame(bytes, bytes_max, more_data, is_pure_ack,
+        bytes = picoquic_format_first_misc_or_dg_frame(cnx, bytes, bytes_max, more_data, is_pure_ack,
             misc_frame, &cnx->first_misc_frame, &cnx->last_misc_frame);
         if (bytes <= bytes_misc) {
             break;
@@ -4647,7 +6503,7 @@ const uint8_t* picoquic_decode_path_challenge_frame(picoquic_cnx_t* cnx, const u
              */
             int is_valid = 0;
 #if 0
-            if (cnx->is_multipath_enabled) {
+            if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                 is_valid = 1;
             }
 #endif
@@ -4749,7 +6605,14 @@ const uint8_t* picoquic_decode_path_response_frame(picoquic_cnx_t* cnx, const ui
                 tuple = tuple->next_tuple;
             }
 
-            if (found_challenge && !tuple->challenge_verified) {
+            if (found_challenge && tuple->is_rebinding_pending) {
+                /* The new port of a fast rebinding is validated. The tuple is
+                 * already in first position, and the path MTU did not change. */
+                tuple->is_rebinding_pending = 0;
+                tuple->is_nat_rebinding = 0;
+                picoquic_update_path_rtt(cnx, path_x, path_x, -1, tuple->challenge_time_first, current_time, 0, 0);
+            }
+            else if (found_challenge && !tuple->challenge_verified) {
                 tuple->challenge_verified = 1;
                 /* Provide a qualified time estimate from challenge time */
                 picoquic_update_path_rtt(cnx, path_x, path_x, -1, tuple->challenge_time_first, current_time, 0, 0);
@@ -4860,6 +6723,12 @@ const uint8_t* picoquic_decode_streams_blocked_frame(picoquic_cnx_t* cnx, const
         if (stream_limit > local_limit) {
             picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_STREAM_LIMIT_ERROR, frame_id);
         }
+        else if (stream_limit == local_limit && cnx->quic->max_streams_increment_max != 0) {
+            /* The peer is waiting for credit: grant more streams per update */
+            int is_unidir = (frame_id == picoquic_frame_type_streams_blocked_unidir);
+            picoquic_streams_autotune_raise(cnx, &cnx->streams_autotune[is_unidir],
+                2 * picoquic_max_streams_increment(cnx, is_unidir));
+        }
     }
     return bytes;
 }
@@ -4985,10 +6854,20 @@ const uint8_t* picoquic_decode_datagram_frame(picoquic_cnx_t* cnx, picoquic_path
         }
     }
 
-    if (bytes != NULL && cnx->callback_fn != NULL) {
+    if (bytes != NULL && cnx->callback_fn != NULL && cnx->is_datagram_batch_enabled && cnx->quic->is_receive_batch_open &&
+        picoquic_datagram_batch_add(cnx, bytes, (size_t)length) == 0) {
+        /* The datagram will be delivered at the end of the receive batch */
+    }
+    else if (bytes != NULL && cnx->callback_fn != NULL) {
         /* submit the data to the app */
-        if (cnx->callback_fn(cnx, (cnx->are_path_callbacks_enabled)?path_x->unique_path_id:0, (uint8_t*)bytes,
-            (size_t)length, picoquic_callback_datagram, cnx->callback_ctx, NULL) != 0) {
+        picoquic_cpu_mark_t cpu_mark;
+        int app_ret;
+
+        picoquic_cpu_mark(cnx->quic, &cpu_mark);
+        app_ret = cnx->callback_fn(cnx, (cnx->are_path_callbacks_enabled)?path_x->unique_path_id:0, (uint8_t*)bytes,
+            (size_t)length, picoquic_callback_datagram, cnx->callback_ctx, NULL);
+        picoquic_cpu_account_app(cnx, &cpu_mark);
+        if (app_ret != 0) {
             picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, picoquic_frame_type_datagram);
             bytes = NULL;
         }
@@ -5050,13 +6929,191 @@ uint8_t * picoquic_format_first_datagram_frame(picoquic_cnx_t* cnx, uint8_t* byt
         *more_data = 1;
     }
     else {
-        bytes = picoquic_format_first_misc_or_dg_frame(bytes, bytes_max, more_data, is_pure_ack, 
+        bytes = picoquic_format_first_misc_or_dg_frame(cnx, bytes, bytes_max, more_data, is_pure_ack, 
             cnx->first_datagram, &cnx->first_datagram, &cnx->last_datagram);
     }
 
     return bytes;
 }
 
+/* Datagram send ring.
+ * The ring and the slot buffers are allocated in a single block, and charged
+ * to the datagram memory category for the lifetime of the ring.
+ */
+static size_t picoquic_datagram_ring_alloc_size(size_t nb_slots, size_t slot_size)
+{
+    return sizeof(picoquic_datagram_ring_t) + nb_slots * (sizeof(picoquic_datagram_slot_t) + slot_size);
+}
+
+void picoquic_datagram_ring_free(picoquic_cnx_t* cnx)
+{
+    if (cnx->datagram_ring != NULL) {
+        picoquic_memory_discharge(cnx, picoquic_memory_datagram,
+            picoquic_datagram_ring_alloc_size(cnx->datagram_ring->nb_slots, cnx->datagram_ring->slot_size));
+        free(cnx->datagram_ring);
+        cnx->datagram_ring = NULL;
+    }
+}
+
+int picoquic_set_datagram_send_ring(picoquic_cnx_t* cnx, size_t nb_slots, size_t slot_size)
+{
+    int ret = 0;
+
+    if (nb_slots > 0 && (slot_size == 0 || slot_size > PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH)) {
+        ret = PICOQUIC_ERROR_DATAGRAM_TOO_LONG;
+    }
+    else {
+        picoquic_datagram_ring_free(cnx);
+
+        if (nb_slots > 0) {
+            size_t alloc_size = picoquic_datagram_ring_alloc_size(nb_slots, slot_size);
+            picoquic_datagram_ring_t* ring = (picoquic_datagram_ring_t*)malloc(alloc_size);
+
+            if (ring == NULL) {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                uint8_t* buffer;
+
+                memset(ring, 0, sizeof(picoquic_datagram_ring_t));
+                ring->slots = (picoquic_datagram_slot_t*)(ring + 1);
+                ring->nb_slots = nb_slots;
+                ring->slot_size = slot_size;
+                buffer = (uint8_t*)(ring->slots + nb_slots);
+                for (size_t i = 0; i < nb_slots; i++) {
+                    memset(&ring->slots[i], 0, sizeof(picoquic_datagram_slot_t));
+                    ring->slots[i].bytes = buffer + i * slot_size;
+                }
+                cnx->datagram_ring = ring;
+                picoquic_memory_charge(cnx, picoquic_memory_datagram, alloc_size);
+            }
+        }
+    }
+
+    return ret;
+}
+
+static picoquic_datagram_slot_t* picoquic_datagram_ring_slot(picoquic_datagram_ring_t* ring, size_t rank)
+{
+    return &ring->slots[(ring->first_slot + rank) % ring->nb_slots];
+}
+
+/* Remove the slot at the specified rank. The slots queued before it move up
+ * by one position and keep their rank; the rank of the slots queued after
+ * it decreases by one. */
+static void picoquic_datagram_ring_remove(picoquic_datagram_ring_t* ring, size_t rank)
+{
+    picoquic_datagram_slot_t removed = *picoquic_datagram_ring_slot(ring, rank);
+
+    while (rank > 0) {
+        *picoquic_datagram_ring_slot(ring, rank) = *picoquic_datagram_ring_slot(ring, rank - 1);
+        rank--;
+    }
+    *picoquic_datagram_ring_slot(ring, 0) = removed;
+    ring->first_slot = (ring->first_slot + 1) % ring->nb_slots;
+    ring->nb_queued--;
+}
+
+int picoquic_queue_datagram_to_ring(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length,
+    uint8_t priority, uint64_t expiry_time)
+{
+    int ret = 0;
+    picoquic_datagram_ring_t* ring = cnx->datagram_ring;
+
+    if (ring == NULL) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_STATE;
+    }
+    else if (length > ring->slot_size) {
+        ret = PICOQUIC_ERROR_DATAGRAM_TOO_LONG;
+    }
+    else {
+        if (ring->nb_queued >= ring->nb_slots) {
+            /* Find the least important datagram, preferring the most recent one */
+            size_t victim = 0;
+
+            for (size_t rank = 1; rank < ring->nb_queued; rank++) {
+                if (picoquic_datagram_ring_slot(ring, rank)->priority >= picoquic_datagram_ring_slot(ring, victim)->priority) {
+                    victim = rank;
+                }
+            }
+            if (picoquic_datagram_ring_slot(ring, victim)->priority > priority) {
+                picoquic_datagram_ring_remove(ring, victim);
+                ring->nb_dropped++;
+            }
+            else {
+                ret = PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL;
+            }
+        }
+
+        if (ret == 0) {
+            picoquic_datagram_slot_t* slot = picoquic_datagram_ring_slot(ring, ring->nb_queued);
+
+            if (length > 0) {
+                memcpy(slot->bytes, bytes, length);
+            }
+            slot->length = length;
+            slot->priority = priority;
+            slot->expiry_time = expiry_time;
+            ring->nb_queued++;
+            picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+        }
+    }
+
+    return ret;
+}
+
+/* Drop the expired datagrams, then send the queued datagrams in priority
+ * order, as many as fit in the packet. */
+uint8_t* picoquic_format_ring_datagram_frames(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
+    int* more_data, int* is_pure_ack, uint64_t current_time)
+{
+    picoquic_datagram_ring_t* ring = cnx->datagram_ring;
+    size_t rank = 0;
+
+    while (rank < ring->nb_queued) {
+        picoquic_datagram_slot_t* slot = picoquic_datagram_ring_slot(ring, rank);
+
+        if (slot->expiry_time != 0 && slot->expiry_time <= current_time) {
+            picoquic_datagram_ring_remove(ring, rank);
+            ring->nb_expired++;
+        }
+        else {
+            rank++;
+        }
+    }
+
+    while (ring->nb_queued > 0) {
+        size_t best = 0;
+        uint8_t* bytes_next;
+        picoquic_datagram_slot_t* slot;
+
+        for (rank = 1; rank < ring->nb_queued; rank++) {
+            if (picoquic_datagram_ring_slot(ring, rank)->priority < picoquic_datagram_ring_slot(ring, best)->priority) {
+                best = rank;
+            }
+        }
+        slot = picoquic_datagram_ring_slot(ring, best);
+        bytes_next = picoquic_format_datagram_frame(bytes, bytes_max, more_data, is_pure_ack, slot->length, slot->bytes);
+        if (bytes_next == bytes) {
+            break;
+        }
+        bytes = bytes_next;
+        picoquic_datagram_ring_remove(ring, best);
+    }
+
+    return bytes;
+}
+
+void picoquic_get_datagram_ring_stats(picoquic_cnx_t* cnx, size_t* nb_queued,
+    uint64_t* nb_expired, uint64_t* nb_dropped)
+{
+    picoquic_datagram_ring_t* ring = cnx->datagram_ring;
+
+    *nb_queued = (ring == NULL) ? 0 : ring->nb_queued;
+    *nb_expired = (ring == NULL) ? 0 : ring->nb_expired;
+    *nb_dropped = (ring == NULL) ? 0 : ring->nb_dropped;
+}
+
 /* Provide a datagram buffer for the length specified by the application.
  * The stack called with a pointer to the available space, which may extend
  * to the end of the packet. There are several interesting cases:
@@ -5069,6 +7126,9 @@ uint8_t * picoquic_format_first_datagram_frame(picoquic_cnx_t* cnx, uint8_t* byt
  *     set the low level type bit to 1 to show presence of length
  *     encode the length after the type
  *     return the buffer after length   
+ * If the application calls again during the same callback, the new datagram
+ * is encoded in a new frame after the data of the previous one, with the
+ * same rules.
  */
 
 typedef struct st_picoquic_datagram_buffer_argument_t {
@@ -5107,6 +7167,26 @@ uint8_t* picoquic_provide_datagram_buffer_ex(void* context, size_t length, picoq
         }
     }
 
+    if (length > 0 && data_ctx->after_data > data_ctx->bytes0) {
+        /* A datagram was already provided during this callback. The new one
+         * is placed in a separate DATAGRAM frame, after the previous one, so
+         * that several small datagrams can share the same packet. */
+        uint8_t* frame_start = data_ctx->after_data;
+        uint8_t* bytes = picoquic_frames_varint_encode(frame_start, data_ctx->bytes_max, picoquic_frame_type_datagram_l);
+
+        if (bytes == NULL) {
+            data_ctx->allowed_space = 0;
+        }
+        else {
+            data_ctx->bytes0 = frame_start;
+            data_ctx->bytes = bytes;
+            data_ctx->allowed_space = data_ctx->bytes_max - bytes;
+            if (data_ctx->allowed_space > data_ctx->cnx->remote_parameters.max_datagram_frame_size) {
+                data_ctx->allowed_space = data_ctx->cnx->remote_parameters.max_datagram_frame_size;
+            }
+        }
+    }
+
     if (length > 0 && length <= data_ctx->allowed_space) {
         /* Compute the length of header and length field */
         uint8_t* after_length = picoquic_frames_varint_encode(
@@ -5161,6 +7241,8 @@ uint8_t* picoquic_format_ready_datagram_frame(picoquic_cnx_t* cnx, picoquic_path
         /* Compute the length */
         size_t allowed_space = bytes_max - bytes;
         picoquic_datagram_buffer_argument_t datagram_data_context;
+        picoquic_cpu_mark_t cpu_mark;
+        int app_ret = 0;
 
         if (allowed_space > cnx->remote_parameters.max_datagram_frame_size) {
             allowed_space = cnx->remote_parameters.max_datagram_frame_size;
@@ -5177,8 +7259,14 @@ uint8_t* picoquic_format_ready_datagram_frame(picoquic_cnx_t* cnx, picoquic_path
         datagram_data_context.is_old_api = 0;
         datagram_data_context.was_called = 0;
 
-        if (cnx->callback_fn != NULL && (cnx->callback_fn)(cnx, (cnx->are_path_callbacks_enabled)?path_x->unique_path_id:0, (uint8_t*)&datagram_data_context, allowed_space,
-            picoquic_callback_prepare_datagram, cnx->callback_ctx, NULL) != 0) {
+        if (cnx->callback_fn != NULL) {
+            picoquic_cpu_mark(cnx->quic, &cpu_mark);
+            app_ret = (cnx->callback_fn)(cnx, (cnx->are_path_callbacks_enabled)?path_x->unique_path_id:0, (uint8_t*)&datagram_data_context, allowed_space,
+                picoquic_callback_prepare_datagram, cnx->callback_ctx, NULL);
+            picoquic_cpu_account_app(cnx, &cpu_mark);
+        }
+
+        if (app_ret != 0) {
             /* something went wrong */
             picoquic_log_app_message(cnx, "Prepare datagram returns error 0x%x", PICOQUIC_TRANSPORT_INTERNAL_ERROR);
             *ret = picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
@@ -5276,19 +7364,23 @@ uint8_t* picoquic_format_ack_frequency_frame(picoquic_cnx_t* cnx, uint8_t* bytes
     uint64_t seq = cnx->ack_frequency_sequence_local + 1;
     uint64_t ack_gap;
     uint64_t ack_delay_max;
-    uint64_t reordering_threshold = (cnx->ack_ignore_order_local) ? 0 : 1;
+    uint64_t reordering_threshold = picoquic_ack_frequency_reordering_threshold(cnx);
+    int is_adaptive = cnx->quic->is_adaptive_ack_frequency_enabled;
 
     /* Compute the desired value of the ack frequency*/
     picoquic_compute_ack_gap_and_delay(cnx, cnx->path[0]->rtt_min, cnx->remote_parameters.min_ack_delay,
         cnx->path[0]->bandwidth_estimate, &ack_gap, &ack_delay_max);
     
-    if (ack_gap <= cnx->ack_gap_local &&
+    if (((is_adaptive) ? ack_gap == cnx->ack_gap_local : ack_gap <= cnx->ack_gap_local) &&
         ack_delay_max >= (7*cnx->ack_frequency_delay_local)/8 &&
-        ack_delay_max <= (9* cnx->ack_frequency_delay_local) / 8) {
+        ack_delay_max <= (9* cnx->ack_frequency_delay_local) / 8 &&
+        (!is_adaptive || reordering_threshold == cnx->ack_reordering_threshold_local)) {
         cnx->is_ack_frequency_updated = 0;
     }
     else {
-        if (ack_gap < cnx->ack_gap_local) {
+        /* The default policy never decreases the gap, the adaptive policy
+         * decreases it when congestion control is probing. */
+        if (!is_adaptive && ack_gap < cnx->ack_gap_local) {
             ack_gap = cnx->ack_gap_local;
         }
         if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_frame_type_ack_frequency)) != NULL &&
@@ -5299,6 +7391,7 @@ uint8_t* picoquic_format_ack_frequency_frame(picoquic_cnx_t* cnx, uint8_t* bytes
             cnx->ack_frequency_sequence_local = seq;
             cnx->ack_gap_local = ack_gap;
             cnx->ack_frequency_delay_local = ack_delay_max;
+            cnx->ack_reordering_threshold_local = reordering_threshold;
             cnx->is_ack_frequency_updated = 0;
             if (ack_gap > cnx->max_ack_gap_local) {
                 cnx->max_ack_gap_local = ack_gap;
@@ -5355,6 +7448,21 @@ uint8_t* picoquic_format_immediate_ack_frame(uint8_t* bytes, uint8_t* bytes_max,
     return bytes;
 }
 
+/* Send the IMMEDIATE_ACK requested by the adaptive ACK frequency */
+uint8_t* picoquic_format_immediate_ack_if_pending(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack)
+{
+    uint8_t* bytes_0 = bytes;
+
+    if (cnx->is_immediate_ack_pending) {
+        bytes = picoquic_format_immediate_ack_frame(bytes, bytes_max, more_data);
+        if (bytes > bytes_0) {
+            cnx->is_immediate_ack_pending = 0;
+            *is_pure_ack = 0;
+        }
+    }
+    return bytes;
+}
+
 
 /* Time stamp frames
  */
@@ -5445,7 +7553,7 @@ const uint8_t* picoquic_decode_path_abandon_frame(const uint8_t* bytes, const ui
 
     /* This code assumes that the frame type is already skipped */
 
-    if (!cnx->is_multipath_enabled) {
+    if (!PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* Frame is unexpected */
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             picoquic_frame_type_path_abandon, "multipath not negotiated");
@@ -5571,7 +7679,7 @@ int picoquic_queue_path_available_or_backup_frame(
         uint64_t frame_type = (status == picoquic_path_status_available) ?
             picoquic_frame_type_path_available : picoquic_frame_type_path_backup;
         uint64_t sequence = cnx->status_sequence_to_send_next++;
-        uint64_t path_id = (cnx->is_multipath_enabled)?
+        uint64_t path_id = (PICOQUIC_CNX_IS_MULTIPATH(cnx))?
             path_x->unique_path_id :
             path_x->first_tuple->p_remote_cnxid->sequence;
         int is_pure_ack = 0;
@@ -5615,7 +7723,7 @@ const uint8_t* picoquic_decode_path_available_or_backup_frame(const uint8_t* byt
 
     /* This code assumes that the frame type is already skipped */
 
-    if (!cnx->is_multipath_enabled) {
+    if (!PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* Frame is unexpected */
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             frame_id64, "multipath not negotiated");
@@ -5726,7 +7834,7 @@ const uint8_t* picoquic_decode_max_path_id_frame(const uint8_t* bytes, const uin
 
     /* This code assumes that the frame type is already skipped */
 
-    if (!cnx->is_multipath_enabled) {
+    if (!PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* Frame is unexpected */
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             picoquic_frame_type_max_path_id, "unique path_id not negotiated");
@@ -5842,7 +7950,7 @@ const uint8_t* picoquic_decode_paths_blocked_frame(const uint8_t* bytes, const u
 
     /* This code assumes that the frame type is already skipped */
 
-    if (!cnx->is_multipath_enabled) {
+    if (!PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* Frame is unexpected */
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             picoquic_frame_type_paths_blocked, "multipath extension not negotiated");
@@ -5981,7 +8089,7 @@ const uint8_t* picoquic_decode_path_cid_blocked_frame(const uint8_t* bytes, cons
 
     /* This code assumes that the frame type is already skipped */
 
-    if (!cnx->is_multipath_enabled) {
+    if (!PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* Frame is unexpected */
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             picoquic_frame_type_path_cid_blocked, "multipath extension not negotiated");
@@ -6180,7 +8288,7 @@ const uint8_t* picoquic_decode_observed_address_frame(picoquic_cnx_t* cnx, const
 
     /* This code assumes that the frame type is already skipped */
 
-    if (!cnx->is_address_discovery_receiver) {
+    if (!PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_RECEIVER(cnx)) {
         /* Frame is unexpected */
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION,
             ftype, "address discovery not negotiated as receiver");
@@ -6278,7 +8386,7 @@ const uint8_t* picoquic_decode_bdp_frame(picoquic_cnx_t* cnx, const uint8_t* byt
     /* This code assumes that the frame type is already skipped */
     if ((bytes = picoquic_parse_bdp_frame(cnx, bytes, bytes_max, &lifetime, &recon_bytes_in_flight, &recon_min_rtt, 
         &saved_ip_length, &saved_ip))  != NULL) {
-        if (cnx->send_receive_bdp_frame) {
+        if (PICOQUIC_CNX_IS_BDP_FRAME_ENABLED(cnx)) {
             if (cnx->client_mode) {
                 path_x->cwin_remote = recon_bytes_in_flight;
                 path_x->rtt_min_remote = recon_min_rtt;
@@ -6325,55 +8433,236 @@ uint8_t* picoquic_format_bdp_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t*
     uint8_t* ip_addr = NULL;
     uint8_t ip_addr_length = 0;
 
-    /* Server sends bdp reflecting current path caracteristics */
-    if (!cnx->client_mode) {
-        if (path_x->is_ticket_seeded && !path_x->is_bdp_sent) {
-            picoquic_issued_ticket_t* server_ticket;
-            server_ticket = picoquic_retrieve_issued_ticket(cnx->quic, cnx->issued_ticket_id);
-            if (server_ticket != NULL && server_ticket->cwin > 0) {
-                recon_bytes_in_flight =  server_ticket->cwin;
-                recon_min_rtt = server_ticket->rtt;
-                ip_addr = server_ticket->ip_addr;
-                ip_addr_length = server_ticket->ip_addr_length;
+    /* Server sends bdp reflecting current path caracteristics */
+    if (!cnx->client_mode) {
+        if (path_x->is_ticket_seeded && !path_x->is_bdp_sent) {
+            picoquic_issued_ticket_t* server_ticket;
+            server_ticket = picoquic_retrieve_issued_ticket(cnx->quic, cnx->issued_ticket_id);
+            if (server_ticket != NULL && server_ticket->cwin > 0) {
+                recon_bytes_in_flight =  server_ticket->cwin;
+                recon_min_rtt = server_ticket->rtt;
+                ip_addr = server_ticket->ip_addr;
+                ip_addr_length = server_ticket->ip_addr_length;
+            }
+        }
+    }
+    else {
+        /* Client sends bdp back to the server */
+        picoquic_stored_ticket_t* stored_ticket = picoquic_get_stored_ticket(cnx->quic,
+            cnx->sni, (uint16_t)strlen(cnx->sni), cnx->alpn, (uint16_t)strlen(cnx->alpn),
+            picoquic_supported_versions[cnx->version_index].version, 1, 0);
+        if (stored_ticket != NULL) {
+            recon_bytes_in_flight = stored_ticket->tp_0rtt[picoquic_tp_0rtt_cwin_remote];
+            recon_min_rtt = stored_ticket->tp_0rtt[picoquic_tp_0rtt_rtt_remote];
+            /* IP address */
+            ip_addr = stored_ticket->ip_addr_client;
+            ip_addr_length = stored_ticket->ip_addr_client_length;
+        }
+    }
+
+    if (recon_bytes_in_flight == 0 ||
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_frame_type_bdp)) == NULL || 
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, lifetime)) == NULL || 
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, recon_bytes_in_flight)) == NULL || 
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, recon_min_rtt)) == NULL ||
+        (bytes = picoquic_frames_length_data_encode(bytes, bytes_max, ip_addr_length, ip_addr)) == NULL) {
+        bytes = bytes0;
+    }
+    else {
+        *is_pure_ack = 0;
+        path_x->is_bdp_sent = 1;
+    }
+
+    return bytes;
+}
+
+/*
+ * Decoding of the received frames.
+ *
+ * In some cases, the expected frames are "restricted" to only ACK, STREAM 0 and PADDING.
+ *
+ * All the frame types defined in RFC 9000, plus the datagram frames, are
+ * encoded as a single byte varint. Their properties are found in a table
+ * indexed by the first byte of the frame, which replaces a series of tests
+ * for each received frame. Extension frames with longer types are handled
+ * by a separate fallback function, so that they do not slow down the common
+ * case.
+ */
+#define PICOQUIC_FRAME_CLASS_KNOWN 0x01 /* Frame type is fully defined by the first byte */
+#define PICOQUIC_FRAME_CLASS_HANDSHAKE 0x02 /* Allowed in Initial and Handshake packets */
+#define PICOQUIC_FRAME_CLASS_NOT_0RTT 0x04 /* Not allowed in 0-RTT packets */
+#define PICOQUIC_FRAME_CLASS_ACK_NEEDED 0x08 /* Receiving this frame requires an acknowledgement */
+#define PICOQUIC_FRAME_CLASS_PROBING 0x10 /* Path probing frame */
+#define PICOQUIC_FRAME_CLASS_MAX 0x40 /* Single byte varints */
+
+#define PICOQUIC_FC_ACK_NEEDED (PICOQUIC_FRAME_CLASS_KNOWN | PICOQUIC_FRAME_CLASS_ACK_NEEDED)
+#define PICOQUIC_FC_STREAM PICOQUIC_FC_ACK_NEEDED
+
+static const uint8_t picoquic_frame_class[PICOQUIC_FRAME_CLASS_MAX] = {
+    /* 0x00, padding */ PICOQUIC_FRAME_CLASS_KNOWN | PICOQUIC_FRAME_CLASS_HANDSHAKE | PICOQUIC_FRAME_CLASS_PROBING,
+    /* 0x01, ping */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_HANDSHAKE,
+    /* 0x02, ack */ PICOQUIC_FRAME_CLASS_KNOWN | PICOQUIC_FRAME_CLASS_HANDSHAKE | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x03, ack_ecn */ PICOQUIC_FRAME_CLASS_KNOWN | PICOQUIC_FRAME_CLASS_HANDSHAKE | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x04, reset_stream */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x05, stop_sending */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x06, crypto_hs */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_HANDSHAKE | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x07, new_token */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x08 to 0x0f, stream */
+    PICOQUIC_FC_STREAM, PICOQUIC_FC_STREAM, PICOQUIC_FC_STREAM, PICOQUIC_FC_STREAM,
+    PICOQUIC_FC_STREAM, PICOQUIC_FC_STREAM, PICOQUIC_FC_STREAM, PICOQUIC_FC_STREAM,
+    /* 0x10, max_data */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x11, max_stream_data */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x12, max_streams_bidir */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x13, max_streams_unidir */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x14, data_blocked */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x15, stream_data_blocked */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x16, streams_blocked_bidir */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x17, streams_blocked_unidir */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x18, new_connection_id */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_PROBING,
+    /* 0x19, retire_connection_id */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x1a, path_challenge */ PICOQUIC_FRAME_CLASS_KNOWN | PICOQUIC_FRAME_CLASS_PROBING,
+    /* 0x1b, path_response */ PICOQUIC_FRAME_CLASS_KNOWN | PICOQUIC_FRAME_CLASS_PROBING | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x1c, connection_close */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_HANDSHAKE,
+    /* 0x1d, application_close */ PICOQUIC_FC_ACK_NEEDED,
+    /* 0x1e, handshake_done */ PICOQUIC_FC_ACK_NEEDED | PICOQUIC_FRAME_CLASS_NOT_0RTT,
+    /* 0x1f, immediate_ack, handled as extension */ 0,
+    /* 0x20 to 0x2f, not defined */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x30, 0x31, datagram */ PICOQUIC_FC_ACK_NEEDED, PICOQUIC_FC_ACK_NEEDED,
+    /* 0x32 to 0x3f, not defined */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* Padding typically fills the end of short packets, in long runs of zeroes.
+ * Skip the run eight bytes at a time before checking the remaining bytes.
+ */
+static const uint8_t* picoquic_skip_padding_frames(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    bytes++;
+    while (bytes + 8 <= bytes_max) {
+        uint64_t bytes64;
+        memcpy(&bytes64, bytes, 8);
+        if (bytes64 != 0) {
+            break;
+        }
+        bytes += 8;
+    }
+    while (bytes < bytes_max && *bytes == picoquic_frame_type_padding) {
+        bytes++;
+    }
+    return bytes;
+}
+
+static const uint8_t* picoquic_decode_extension_frame(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    const uint8_t* bytes, const uint8_t* bytes_max, int epoch, struct sockaddr* addr_from,
+    uint64_t current_time, picoquic_packet_data_t* packet_data, int* ack_needed, int* is_path_probing_frame)
+{
+    uint64_t frame_id64;
+    uint8_t first_byte = bytes[0];
+    const uint8_t* bytes0 = bytes;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_id64)) != NULL) {
+        if (epoch == picoquic_epoch_0rtt &&
+            frame_id64 != picoquic_frame_type_bdp) {
+            /* By default, extension frames should not be used in 0rtt */
+            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
+            bytes = NULL;
+        }
+        else {
+            switch (frame_id64) {
+            case picoquic_frame_type_ack_frequency:
+                bytes = picoquic_decode_ack_frequency_frame(bytes, bytes_max, cnx);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_immediate_ack:
+                bytes = picoquic_decode_immediate_ack_frame(bytes, bytes_max, cnx, path_x, current_time);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_time_stamp:
+                bytes = picoquic_decode_time_stamp_frame(bytes, bytes_max, cnx, packet_data);
+                break;
+            case picoquic_frame_type_path_ack: {
+                bytes = picoquic_decode_ack_frame(cnx, bytes0, bytes_max, current_time, epoch, 0, 1, packet_data);
+                break;
+            }
+            case picoquic_frame_type_path_ack_ecn: {
+                bytes = picoquic_decode_ack_frame(cnx, bytes0, bytes_max, current_time, epoch, 1, 1, packet_data);
+                break;
+            }
+            case picoquic_frame_type_path_abandon:
+                bytes = picoquic_decode_path_abandon_frame(bytes, bytes_max, cnx, current_time);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_path_backup:
+            case picoquic_frame_type_path_available:
+                bytes = picoquic_decode_path_available_or_backup_frame(bytes, bytes_max, frame_id64, cnx, current_time);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_max_path_id:
+                bytes = picoquic_decode_max_path_id_frame(bytes, bytes_max, cnx);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_paths_blocked:
+                bytes = picoquic_decode_paths_blocked_frame(bytes, bytes_max, cnx);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_path_cid_blocked:
+                bytes = picoquic_decode_path_cid_blocked_frame(bytes, bytes_max, cnx);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_path_new_connection_id:
+                *is_path_probing_frame = 1;
+                bytes = picoquic_decode_new_connection_id_frame(cnx, bytes0, bytes_max, current_time, 1);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_path_retire_connection_id:
+                bytes = picoquic_decode_retire_connection_id_frame(cnx, bytes0, bytes_max, current_time, path_x, 1);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_bdp:
+                if (cnx->client_mode && epoch != picoquic_epoch_1rtt) {
+                    DBG_PRINTF("BDP frame (0x%x) is expected in 1-RTT packet", first_byte);
+                    picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
+                    bytes = NULL;
+                    break;
+                }
+                if (!cnx->client_mode && epoch != picoquic_epoch_0rtt && epoch != picoquic_epoch_1rtt) {
+                    DBG_PRINTF("BDP frame (0x%x) is expected in 0-RTT packet", first_byte);
+                    picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
+                    bytes = NULL;
+                    break;
+                }
+                if (cnx->client_mode && cnx->local_parameters.enable_bdp_frame == 0) {
+                    DBG_PRINTF("BDP frame (0x%x) not expected", first_byte);
+                    picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, 0);
+                    bytes = NULL;
+                    break;
+                }
+
+                bytes = picoquic_decode_bdp_frame(cnx, bytes, bytes_max, current_time, addr_from, path_x);
+                *ack_needed = 1;
+                break;
+            case picoquic_frame_type_observed_address_v4:
+            case picoquic_frame_type_observed_address_v6:
+                *is_path_probing_frame = 1;
+                *ack_needed = 1;
+                bytes = picoquic_decode_observed_address_frame(cnx, bytes, bytes_max, path_x, frame_id64);
+                break;
+            case picoquic_frame_type_fec_repair:
+                bytes = picoquic_decode_fec_repair_frame(cnx, bytes, bytes_max);
+                break;
+            default:
+                /* Not implemented yet! */
+                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, frame_id64);
+                bytes = NULL;
+                break;
             }
         }
     }
-    else {
-        /* Client sends bdp back to the server */
-        picoquic_stored_ticket_t* stored_ticket = picoquic_get_stored_ticket(cnx->quic,
-            cnx->sni, (uint16_t)strlen(cnx->sni), cnx->alpn, (uint16_t)strlen(cnx->alpn),
-            picoquic_supported_versions[cnx->version_index].version, 1, 0);
-        if (stored_ticket != NULL) {
-            recon_bytes_in_flight = stored_ticket->tp_0rtt[picoquic_tp_0rtt_cwin_remote];
-            recon_min_rtt = stored_ticket->tp_0rtt[picoquic_tp_0rtt_rtt_remote];
-            /* IP address */
-            ip_addr = stored_ticket->ip_addr_client;
-            ip_addr_length = stored_ticket->ip_addr_client_length;
-        }
-    }
-
-    if (recon_bytes_in_flight == 0 ||
-        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, picoquic_frame_type_bdp)) == NULL || 
-        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, lifetime)) == NULL || 
-        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, recon_bytes_in_flight)) == NULL || 
-        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, recon_min_rtt)) == NULL ||
-        (bytes = picoquic_frames_length_data_encode(bytes, bytes_max, ip_addr_length, ip_addr)) == NULL) {
-        bytes = bytes0;
-    }
-    else {
-        *is_pure_ack = 0;
-        path_x->is_bdp_sent = 1;
-    }
 
     return bytes;
 }
 
-/*
- * Decoding of the received frames.
- *
- * In some cases, the expected frames are "restricted" to only ACK, STREAM 0 and PADDING.
- */
-
 int picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t * path_x, const uint8_t* bytes,
     size_t bytes_maxsize,
     picoquic_stream_data_node_t* received_data,
@@ -6393,260 +8682,126 @@ int picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t * path_x, const
 
     while (bytes != NULL && bytes < bytes_max) {
         uint8_t first_byte = bytes[0];
+        uint8_t frame_class = (first_byte < PICOQUIC_FRAME_CLASS_MAX) ? picoquic_frame_class[first_byte] : 0;
         int is_path_probing_frame = 0;
 
-        if (PICOQUIC_IN_RANGE(first_byte, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
-            if (epoch != picoquic_epoch_0rtt && epoch != picoquic_epoch_1rtt) {
-                DBG_PRINTF("Data frame (0x%x), when only TLS stream is expected", first_byte);
-                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-                bytes = NULL;
-                break;
-            }
-
-            bytes = picoquic_decode_stream_frame(cnx, bytes, bytes_max, received_data, current_time);
-            ack_needed = 1;
-
-        }
-        else if (first_byte == picoquic_frame_type_ack) {
-            if (epoch == picoquic_epoch_0rtt) {
-                DBG_PRINTF("Ack frame (0x%x) not expected in 0-RTT packet", first_byte);
-                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-                bytes = NULL;
-                break;
-            }
-            bytes = picoquic_decode_ack_frame(cnx, bytes, bytes_max, current_time, epoch, 0, 0, &packet_data);
-        }
-        else if (first_byte == picoquic_frame_type_ack_ecn) {
-            if (epoch == picoquic_epoch_0rtt) {
-                DBG_PRINTF("Ack-ECN frame (0x%x) not expected in 0-RTT packet", first_byte);
-                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-                bytes = NULL;
-                break;
-            }
-            bytes = picoquic_decode_ack_frame(cnx, bytes, bytes_max, current_time, epoch, 1, 0, &packet_data);
-        }
-        else if (epoch != picoquic_epoch_0rtt && epoch != picoquic_epoch_1rtt && first_byte != picoquic_frame_type_padding
-            && first_byte != picoquic_frame_type_ping
-            && first_byte != picoquic_frame_type_connection_close
-            && first_byte != picoquic_frame_type_crypto_hs) {
-            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-            bytes = NULL;
-            break;
-        }
-        else if (epoch == picoquic_epoch_0rtt && (first_byte == picoquic_frame_type_crypto_hs
-            || first_byte == picoquic_frame_type_handshake_done
-            || first_byte == picoquic_frame_type_new_token
-            || first_byte == picoquic_frame_type_path_response
-            || first_byte == picoquic_frame_type_retire_connection_id)) {
-            /* From draft-31:
+        if (epoch != picoquic_epoch_1rtt &&
+            ((epoch == picoquic_epoch_0rtt) ? (frame_class & PICOQUIC_FRAME_CLASS_NOT_0RTT) != 0 :
+                (frame_class & PICOQUIC_FRAME_CLASS_HANDSHAKE) == 0)) {
+            /* Only padding, ping, ack, crypto and connection close are allowed in
+             * Initial and Handshake packets.
+             * From draft-31:
              * Note that it is not possible to send the following frames in 0-RTT
              * packets for various reasons : ACK, CRYPTO, HANDSHAKE_DONE, NEW_TOKEN,
              * PATH_RESPONSE, and RETIRE_CONNECTION_ID.A server MAY treat receipt
              * of these frames in 0 - RTT packets as a connection error of type
              * PROTOCOL_VIOLATION.
              */
+            DBG_PRINTF("Frame (0x%x) not expected in epoch %d", first_byte, epoch);
             picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
             bytes = NULL;
             break;
         }
+
+        if ((frame_class & PICOQUIC_FRAME_CLASS_KNOWN) == 0) {
+            bytes = picoquic_decode_extension_frame(cnx, path_x, bytes, bytes_max, epoch, addr_from,
+                current_time, &packet_data, &ack_needed, &is_path_probing_frame);
+        }
         else {
-            switch (first_byte) {
-            case picoquic_frame_type_padding:
-                is_path_probing_frame = 1;
-                bytes = picoquic_skip_0len_frame(bytes, bytes_max);
-                break;
-            case picoquic_frame_type_reset_stream:
-                bytes = picoquic_decode_stream_reset_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_connection_close:
-                bytes = picoquic_decode_connection_close_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_application_close:
-                bytes = picoquic_decode_application_close_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_max_data:
-                bytes = picoquic_decode_max_data_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_max_stream_data:
-                bytes = picoquic_decode_max_stream_data_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_max_streams_bidir:
-            case picoquic_frame_type_max_streams_unidir:
-                bytes = picoquic_decode_max_streams_frame(cnx, bytes, bytes_max, first_byte);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_ping:
-                bytes = picoquic_skip_0len_frame(bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_data_blocked:
-                bytes = picoquic_decode_blocked_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_stream_data_blocked:
-                bytes = picoquic_decode_stream_blocked_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_streams_blocked_unidir:
-            case picoquic_frame_type_streams_blocked_bidir:
-                bytes = picoquic_decode_streams_blocked_frame(cnx, bytes, bytes_max, first_byte);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_new_connection_id:
-                is_path_probing_frame = 1;
-                bytes = picoquic_decode_new_connection_id_frame(cnx, bytes, bytes_max, current_time, 0);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_stop_sending:
-                bytes = picoquic_decode_stop_sending_frame(cnx, bytes, bytes_max);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_path_challenge:
-                is_path_probing_frame = 1;
-                bytes = picoquic_decode_path_challenge_frame(cnx, bytes, bytes_max, 
-                    (path_is_not_allocated)?NULL:path_x, addr_from, addr_to);
-                break;
-            case picoquic_frame_type_path_response:
-                is_path_probing_frame = 1;
-                bytes = picoquic_decode_path_response_frame(cnx, bytes, bytes_max,
-                    (path_is_not_allocated) ? NULL : path_x, current_time);
-                break;
-            case picoquic_frame_type_crypto_hs:
-                bytes = picoquic_decode_crypto_hs_frame(cnx, bytes, bytes_max, received_data, epoch);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_new_token:
-                bytes = picoquic_decode_new_token_frame(cnx, bytes, bytes_max, current_time, addr_to);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_retire_connection_id:
-                /* the old code point for ACK frames, but this is taken care of in the ACK tests above */
-                bytes = picoquic_decode_retire_connection_id_frame(cnx, bytes, bytes_max, current_time, path_x, 0);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_handshake_done:
-                bytes = picoquic_decode_handshake_done_frame(cnx, bytes, current_time);
-                ack_needed = 1;
-                break;
-            case picoquic_frame_type_datagram:
-            case picoquic_frame_type_datagram_l:
-                /* Datagram carrying packets are acked, but not repeated */
-                ack_needed = 1;
-                bytes = picoquic_decode_datagram_frame(cnx, path_x, bytes, bytes_max);
-                break;
-            default: {
-                uint64_t frame_id64;
-                const uint8_t* bytes0 = bytes;
-
-                if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_id64)) != NULL) {
-                    if (epoch == picoquic_epoch_0rtt &&
-                        frame_id64 != picoquic_frame_type_bdp) {
-                        /* By default, extension frames should not be used in 0rtt */
-                        picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-                        bytes = NULL;
-                    }
-                    else {
-                        switch (frame_id64) {
-                        case picoquic_frame_type_ack_frequency:
-                            bytes = picoquic_decode_ack_frequency_frame(bytes, bytes_max, cnx);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_immediate_ack:
-                            bytes = picoquic_decode_immediate_ack_frame(bytes, bytes_max, cnx, path_x, current_time);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_time_stamp:
-                            bytes = picoquic_decode_time_stamp_frame(bytes, bytes_max, cnx, &packet_data);
-                            break;
-                        case picoquic_frame_type_path_ack: {
-                            bytes = picoquic_decode_ack_frame(cnx, bytes0, bytes_max, current_time, epoch, 0, 1, &packet_data);
-                            break;
-                        }
-                        case picoquic_frame_type_path_ack_ecn: {
-                            bytes = picoquic_decode_ack_frame(cnx, bytes0, bytes_max, current_time, epoch, 1, 1, &packet_data);
-                            break;
-                        }
-                        case picoquic_frame_type_path_abandon:
-                            bytes = picoquic_decode_path_abandon_frame(bytes, bytes_max, cnx, current_time);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_path_backup:
-                        case picoquic_frame_type_path_available:
-                            bytes = picoquic_decode_path_available_or_backup_frame(bytes, bytes_max, frame_id64, cnx, current_time);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_max_path_id:
-                            bytes = picoquic_decode_max_path_id_frame(bytes, bytes_max, cnx);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_paths_blocked:
-                            bytes = picoquic_decode_paths_blocked_frame(bytes, bytes_max, cnx);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_path_cid_blocked:
-                            bytes = picoquic_decode_path_cid_blocked_frame(bytes, bytes_max, cnx);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_path_new_connection_id:
-                            is_path_probing_frame = 1;
-                            bytes = picoquic_decode_new_connection_id_frame(cnx, bytes0, bytes_max, current_time, 1);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_path_retire_connection_id:
-                            bytes = picoquic_decode_retire_connection_id_frame(cnx, bytes0, bytes_max, current_time, path_x, 1);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_bdp:
-                            if (cnx->client_mode && epoch != picoquic_epoch_1rtt) {
-                                DBG_PRINTF("BDP frame (0x%x) is expected in 1-RTT packet", first_byte);
-                                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-                                bytes = NULL;
-                                break;
-                            }
-                            if (!cnx->client_mode && epoch != picoquic_epoch_0rtt && epoch != picoquic_epoch_1rtt) {
-                                DBG_PRINTF("BDP frame (0x%x) is expected in 0-RTT packet", first_byte);
-                                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, first_byte);
-                                bytes = NULL;
-                                break;
-                            }
-                            if (cnx->client_mode && cnx->local_parameters.enable_bdp_frame == 0) {
-                                DBG_PRINTF("BDP frame (0x%x) not expected", first_byte);
-                                picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, 0);
-                                bytes = NULL;
-                                break;
-                            }
+            ack_needed |= (frame_class & PICOQUIC_FRAME_CLASS_ACK_NEEDED) != 0;
+            is_path_probing_frame = (frame_class & PICOQUIC_FRAME_CLASS_PROBING) != 0;
 
-                            bytes = picoquic_decode_bdp_frame(cnx, bytes, bytes_max, current_time, addr_from, path_x);
-                            ack_needed = 1;
-                            break;
-                        case picoquic_frame_type_observed_address_v4:
-                        case picoquic_frame_type_observed_address_v6:
-                            is_path_probing_frame = 1;
-                            ack_needed = 1;
-                            bytes = picoquic_decode_observed_address_frame(cnx, bytes, bytes_max, path_x, frame_id64);
-                            break;
-                        default:
-                            /* Not implemented yet! */
-                            picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_PROTOCOL_VIOLATION, frame_id64);
-                            bytes = NULL;
-                            break;
-                        }
-                    }
-                }
-                break;
+            /* Fast paths for the most common frames */
+            if (PICOQUIC_IN_RANGE(first_byte, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+                bytes = picoquic_decode_stream_frame(cnx, bytes, bytes_max, received_data, current_time);
+            }
+            else if (first_byte == picoquic_frame_type_ack) {
+                bytes = picoquic_decode_ack_frame(cnx, bytes, bytes_max, current_time, epoch, 0, 0, &packet_data);
+            }
+            else if (first_byte == picoquic_frame_type_padding) {
+                bytes = picoquic_skip_padding_frames(bytes, bytes_max);
             }
+            else {
+                switch (first_byte) {
+                case picoquic_frame_type_ack_ecn:
+                    bytes = picoquic_decode_ack_frame(cnx, bytes, bytes_max, current_time, epoch, 1, 0, &packet_data);
+                    break;
+                case picoquic_frame_type_reset_stream:
+                    bytes = picoquic_decode_stream_reset_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_connection_close:
+                    bytes = picoquic_decode_connection_close_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_application_close:
+                    bytes = picoquic_decode_application_close_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_max_data:
+                    bytes = picoquic_decode_max_data_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_max_stream_data:
+                    bytes = picoquic_decode_max_stream_data_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_max_streams_bidir:
+                case picoquic_frame_type_max_streams_unidir:
+                    bytes = picoquic_decode_max_streams_frame(cnx, bytes, bytes_max, first_byte);
+                    break;
+                case picoquic_frame_type_ping:
+                    bytes = picoquic_skip_0len_frame(bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_data_blocked:
+                    bytes = picoquic_decode_blocked_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_stream_data_blocked:
+                    bytes = picoquic_decode_stream_blocked_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_streams_blocked_unidir:
+                case picoquic_frame_type_streams_blocked_bidir:
+                    bytes = picoquic_decode_streams_blocked_frame(cnx, bytes, bytes_max, first_byte);
+                    break;
+                case picoquic_frame_type_new_connection_id:
+                    bytes = picoquic_decode_new_connection_id_frame(cnx, bytes, bytes_max, current_time, 0);
+                    break;
+                case picoquic_frame_type_stop_sending:
+                    bytes = picoquic_decode_stop_sending_frame(cnx, bytes, bytes_max);
+                    break;
+                case picoquic_frame_type_path_challenge:
+                    bytes = picoquic_decode_path_challenge_frame(cnx, bytes, bytes_max,
+                        (path_is_not_allocated) ? NULL : path_x, addr_from, addr_to);
+                    break;
+                case picoquic_frame_type_path_response:
+                    bytes = picoquic_decode_path_response_frame(cnx, bytes, bytes_max,
+                        (path_is_not_allocated) ? NULL : path_x, current_time);
+                    break;
+                case picoquic_frame_type_crypto_hs:
+                    bytes = picoquic_decode_crypto_hs_frame(cnx, bytes, bytes_max, received_data, epoch);
+                    break;
+                case picoquic_frame_type_new_token:
+                    bytes = picoquic_decode_new_token_frame(cnx, bytes, bytes_max, current_time, addr_to);
+                    break;
+                case picoquic_frame_type_retire_connection_id:
+                    bytes = picoquic_decode_retire_connection_id_frame(cnx, bytes, bytes_max, current_time, path_x, 0);
+                    break;
+                case picoquic_frame_type_handshake_done:
+                    bytes = picoquic_decode_handshake_done_frame(cnx, bytes, current_time);
+                    break;
+                case picoquic_frame_type_datagram:
+                case picoquic_frame_type_datagram_l:
+                    /* Datagram carrying packets are acked, but not repeated */
+                    bytes = picoquic_decode_datagram_frame(cnx, path_x, bytes, bytes_max);
+                    break;
+                default:
+                    /* Cannot happen if the frame class table is consistent */
+                    picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, first_byte);
+                    bytes = NULL;
+                    break;
+                }
             }
         }
         is_path_probing_packet &= is_path_probing_frame;
     }
 
     if (bytes != NULL) {
-        process_decoded_packet_data(cnx, path_x, epoch, current_time, &packet_data);
+        picoquic_ack_batch_add(cnx, path_x, epoch, current_time, &packet_data);
 
         if (ack_needed) {
             cnx->latest_receive_time = current_time;
@@ -6657,6 +8812,7 @@ int picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t * path_x, const
             path_x->last_non_path_probing_pn = pn64;
         }
     }
+    picoquic_packet_data_release(&packet_data);
 
     return bytes != NULL ? 0 : PICOQUIC_ERROR_DETECTED;
 }
@@ -6797,176 +8953,167 @@ static const uint8_t* picoquic_skip_stream_blocked_frame(const uint8_t* bytes, c
 }
 
 
-int picoquic_skip_frame(const uint8_t* bytes, size_t bytes_maxsize, size_t* consumed, int* pure_ack)
+static const uint8_t* picoquic_skip_1varint_frame(const uint8_t* bytes, const uint8_t* bytes_max)
 {
-    const uint8_t *bytes_max = bytes + bytes_maxsize;
-    uint8_t first_byte = bytes[0];
+    return picoquic_frames_varint_skip(bytes + 1, bytes_max);
+}
 
-    *pure_ack = 1;
+static const uint8_t* picoquic_skip_1byte_frame(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    return bytes + 1;
+}
 
-    if (PICOQUIC_IN_RANGE(first_byte, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
-        *pure_ack = 0;
-        bytes = picoquic_skip_stream_frame(bytes, bytes_max);
-    } else {
-        switch (first_byte) {
-        case picoquic_frame_type_ack:
-            bytes = picoquic_skip_ack_frame(bytes, bytes_max);
-            break;
-        case picoquic_frame_type_ack_ecn:
-            bytes = picoquic_skip_ack_ecn_frame(bytes, bytes_max);
-            break;
-        case picoquic_frame_type_padding:
-            bytes = picoquic_skip_0len_frame(bytes, bytes_max);
-            break;
-        case picoquic_frame_type_reset_stream:
-            bytes = picoquic_skip_stream_reset_frame(bytes, bytes_max);
-            *pure_ack = 0;
-            break;
-        case picoquic_frame_type_connection_close: {
-            bytes = picoquic_skip_connection_close_frame(bytes, bytes_max);
+static const uint8_t* picoquic_skip_new_connection_id_frame_v1(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    return picoquic_skip_new_connection_id_frame(bytes, bytes_max, 0);
+}
+
+static const uint8_t* picoquic_skip_retire_connection_id_frame_v1(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    return picoquic_skip_retire_connection_id_frame(bytes, bytes_max, 0);
+}
+
+static const uint8_t* picoquic_skip_path_challenge_frame(const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    /* Same format for path challenge and path response */
+    return picoquic_frames_fixed_skip(bytes + 1, bytes_max, challenge_length);
+}
+
+/* Skip functions for the frame types that are fully defined by their
+ * first byte, i.e., the entries marked "known" in the frame class table.
+ * A frame does not require acknowledgement and is thus "pure ack" if is
+ * not marked as "ack needed" in the frame class table.
+ */
+typedef const uint8_t* (*picoquic_skip_frame_fn)(const uint8_t* bytes, const uint8_t* bytes_max);
+
+static const picoquic_skip_frame_fn picoquic_skip_frame_table[PICOQUIC_FRAME_CLASS_MAX] = {
+    /* 0x00, padding */ picoquic_skip_padding_frames,
+    /* 0x01, ping */ picoquic_skip_0len_frame,
+    /* 0x02, ack */ picoquic_skip_ack_frame,
+    /* 0x03, ack_ecn */ picoquic_skip_ack_ecn_frame,
+    /* 0x04, reset_stream */ picoquic_skip_stream_reset_frame,
+    /* 0x05, stop_sending */ picoquic_skip_stop_sending_frame,
+    /* 0x06, crypto_hs */ picoquic_skip_crypto_hs_frame,
+    /* 0x07, new_token */ picoquic_skip_new_token_frame,
+    /* 0x08 to 0x0f, stream */
+    picoquic_skip_stream_frame, picoquic_skip_stream_frame, picoquic_skip_stream_frame, picoquic_skip_stream_frame,
+    picoquic_skip_stream_frame, picoquic_skip_stream_frame, picoquic_skip_stream_frame, picoquic_skip_stream_frame,
+    /* 0x10, max_data */ picoquic_skip_1varint_frame,
+    /* 0x11, max_stream_data */ picoquic_skip_max_stream_data_frame,
+    /* 0x12, max_streams_bidir */ picoquic_skip_1varint_frame,
+    /* 0x13, max_streams_unidir */ picoquic_skip_1varint_frame,
+    /* 0x14, data_blocked */ picoquic_skip_1varint_frame,
+    /* 0x15, stream_data_blocked */ picoquic_skip_stream_blocked_frame,
+    /* 0x16, streams_blocked_bidir */ picoquic_skip_1varint_frame,
+    /* 0x17, streams_blocked_unidir */ picoquic_skip_1varint_frame,
+    /* 0x18, new_connection_id */ picoquic_skip_new_connection_id_frame_v1,
+    /* 0x19, retire_connection_id */ picoquic_skip_retire_connection_id_frame_v1,
+    /* 0x1a, path_challenge */ picoquic_skip_path_challenge_frame,
+    /* 0x1b, path_response */ picoquic_skip_path_challenge_frame,
+    /* 0x1c, connection_close */ picoquic_skip_connection_close_frame,
+    /* 0x1d, application_close */ picoquic_skip_application_close_frame,
+    /* 0x1e, handshake_done */ picoquic_skip_1byte_frame,
+    /* 0x1f, immediate_ack, handled as extension */ NULL,
+    /* 0x20 to 0x2f, not defined */
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    /* 0x30, 0x31, datagram */ picoquic_skip_datagram_frame, picoquic_skip_datagram_frame,
+    /* 0x32 to 0x3f, not defined */
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static const uint8_t* picoquic_skip_extension_frame(const uint8_t* bytes, const uint8_t* bytes_max, int* pure_ack)
+{
+    uint64_t frame_id64;
+    const uint8_t * bytes_before_type = bytes;
+
+    if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_id64)) != NULL) {
+        switch (frame_id64) {
+        case picoquic_frame_type_ack_frequency:
+            bytes = picoquic_skip_ack_frequency_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        }
-        case picoquic_frame_type_application_close: {
-            bytes = picoquic_skip_application_close_frame(bytes, bytes_max);
+        case picoquic_frame_type_immediate_ack:
+            bytes = picoquic_skip_immediate_ack_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        }
-        case picoquic_frame_type_max_data:
-            bytes = picoquic_frames_varint_skip(bytes+1, bytes_max);
-            *pure_ack = 0;
+        case picoquic_frame_type_time_stamp:
+            bytes = picoquic_skip_time_stamp_frame(bytes, bytes_max);
             break;
-        case picoquic_frame_type_max_stream_data:
-            bytes = picoquic_skip_max_stream_data_frame(bytes, bytes_max);
-            *pure_ack = 0;
+        case picoquic_frame_type_path_ack:
+            bytes = picoquic_skip_ack_frame_maybe_ecn(bytes_before_type, bytes_max, 0, 1);
             break;
-        case picoquic_frame_type_max_streams_bidir:
-        case picoquic_frame_type_max_streams_unidir:
-            bytes = picoquic_frames_varint_skip(bytes+1, bytes_max);
-            *pure_ack = 0;
+        case picoquic_frame_type_path_ack_ecn:
+            bytes = picoquic_skip_ack_frame_maybe_ecn(bytes_before_type, bytes_max, 1, 1);
             break;
-        case picoquic_frame_type_ping:
-            bytes = picoquic_skip_0len_frame(bytes, bytes_max);
+        case picoquic_frame_type_path_abandon:
+            bytes = picoquic_skip_path_abandon_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_data_blocked:
-            bytes = picoquic_frames_varint_skip(bytes+1, bytes_max);
+        case picoquic_frame_type_path_backup:
+        case picoquic_frame_type_path_available:
+            bytes = picoquic_skip_path_available_or_backup_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_stream_data_blocked:
-            bytes = picoquic_skip_stream_blocked_frame(bytes, bytes_max);
+        case picoquic_frame_type_max_path_id:
+            bytes = picoquic_skip_max_path_id_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_streams_blocked_bidir:
-        case picoquic_frame_type_streams_blocked_unidir:
-            bytes = picoquic_frames_varint_skip(bytes+1, bytes_max);
+        case picoquic_frame_type_paths_blocked:
+            bytes = picoquic_skip_paths_blocked_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_new_connection_id:
-            bytes = picoquic_skip_new_connection_id_frame(bytes, bytes_max, 0);
+        case picoquic_frame_type_path_cid_blocked:
+            bytes = picoquic_skip_path_cid_blocked_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_stop_sending:
-            bytes = picoquic_skip_stop_sending_frame(bytes, bytes_max);
+        case picoquic_frame_type_bdp:
+            bytes = picoquic_skip_bdp_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_path_challenge:
-            bytes = picoquic_frames_fixed_skip(bytes+1, bytes_max, challenge_length);
-            break;
-        case picoquic_frame_type_path_response:
-            bytes = picoquic_frames_fixed_skip(bytes+1, bytes_max, challenge_length);
-            break;
-        case picoquic_frame_type_crypto_hs:
-            bytes = picoquic_skip_crypto_hs_frame(bytes, bytes_max);
+        case picoquic_frame_type_path_new_connection_id:
+            bytes = picoquic_skip_new_connection_id_frame(bytes_before_type, bytes_max, 1);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_new_token:
-            bytes = picoquic_skip_new_token_frame(bytes, bytes_max);
+        case picoquic_frame_type_path_retire_connection_id:
+            bytes = picoquic_skip_retire_connection_id_frame(bytes_before_type, bytes_max, 1);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_retire_connection_id:
-            bytes = picoquic_skip_retire_connection_id_frame(bytes, bytes_max, 0);
+        case picoquic_frame_type_observed_address_v4:
+        case picoquic_frame_type_observed_address_v6:
+            bytes = picoquic_skip_observed_address_frame(bytes, bytes_max, frame_id64);
             *pure_ack = 0;
             break;
-        case picoquic_frame_type_handshake_done:
-            bytes = bytes + 1;
-            *pure_ack = 0;
+        case picoquic_frame_type_fec_repair:
+            bytes = picoquic_skip_fec_repair_frame(bytes, bytes_max);
             break;
-        case picoquic_frame_type_datagram:
-        case picoquic_frame_type_datagram_l:
-            bytes = picoquic_skip_datagram_frame(bytes, bytes_max);
+        case picoquic_frame_type_stream_metadata:
+            bytes = picoquic_skip_stream_metadata_frame(bytes, bytes_max);
             *pure_ack = 0;
             break;
-        default: {
-            uint64_t frame_id64;
-            const uint8_t * bytes_before_type = bytes;
-            if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_id64)) != NULL) {
-                switch (frame_id64) {
-                case picoquic_frame_type_ack_frequency:
-                    bytes = picoquic_skip_ack_frequency_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_immediate_ack:
-                    bytes = picoquic_skip_immediate_ack_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_time_stamp:
-                    bytes = picoquic_skip_time_stamp_frame(bytes, bytes_max);
-                    break;
-                case picoquic_frame_type_path_ack:
-                    bytes = picoquic_skip_ack_frame_maybe_ecn(bytes_before_type, bytes_max, 0, 1);
-                    break;
-                case picoquic_frame_type_path_ack_ecn:
-                    bytes = picoquic_skip_ack_frame_maybe_ecn(bytes_before_type, bytes_max, 1, 1);
-                    break;
-                case picoquic_frame_type_path_abandon:
-                    bytes = picoquic_skip_path_abandon_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_path_backup:
-                case picoquic_frame_type_path_available:
-                    bytes = picoquic_skip_path_available_or_backup_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_max_path_id:
-                    bytes = picoquic_skip_max_path_id_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_paths_blocked:
-                    bytes = picoquic_skip_paths_blocked_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_path_cid_blocked:
-                    bytes = picoquic_skip_path_cid_blocked_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_bdp:
-                    bytes = picoquic_skip_bdp_frame(bytes, bytes_max);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_path_new_connection_id:
-                    bytes = picoquic_skip_new_connection_id_frame(bytes_before_type, bytes_max, 1);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_path_retire_connection_id:
-                    bytes = picoquic_skip_retire_connection_id_frame(bytes_before_type, bytes_max, 1);
-                    *pure_ack = 0;
-                    break;
-                case picoquic_frame_type_observed_address_v4:
-                case picoquic_frame_type_observed_address_v6:
-                    bytes = picoquic_skip_observed_address_frame(bytes, bytes_max, frame_id64);
-                    *pure_ack = 0;
-                    break;
-                default:
-                    /* Not implemented yet! */
-                    bytes = NULL;
-                }
-            }
-            break;
-        }
+        default:
+            /* Not implemented yet! */
+            bytes = NULL;
         }
     }
 
+    return bytes;
+}
+
+int picoquic_skip_frame(const uint8_t* bytes, size_t bytes_maxsize, size_t* consumed, int* pure_ack)
+{
+    const uint8_t *bytes_max = bytes + bytes_maxsize;
+    uint8_t first_byte = bytes[0];
+    uint8_t frame_class = (first_byte < PICOQUIC_FRAME_CLASS_MAX) ? picoquic_frame_class[first_byte] : 0;
+
+    if ((frame_class & PICOQUIC_FRAME_CLASS_KNOWN) != 0) {
+        *pure_ack = (frame_class & PICOQUIC_FRAME_CLASS_ACK_NEEDED) == 0;
+        bytes = picoquic_skip_frame_table[first_byte](bytes, bytes_max);
+    }
+    else {
+        *pure_ack = 1;
+        bytes = picoquic_skip_extension_frame(bytes, bytes_max, pure_ack);
+    }
+
     *consumed = (bytes != NULL) ? bytes_maxsize - (bytes_max - bytes) : bytes_maxsize;
 
     return bytes == NULL;
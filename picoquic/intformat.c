@@ -23,6 +23,7 @@
 #ifndef WIN32
 #include <sys/types.h>
 #endif
+#include "picoquic_internal.h"
 
 void picoformat_16(uint8_t* bytes, uint16_t n16)
 {
@@ -82,6 +83,10 @@ size_t picoquic_encode_varint_length(uint64_t n64)
     }
 }
 
+/* Shift and mask applied to an 8 octets load, per varint length code, see PICOPARSE_VARINT_8 */
+const uint8_t picoquic_varint_shift[4] = { 56, 48, 32, 0 };
+const uint64_t picoquic_varint_mask[4] = { 0x3F, 0x3FFF, 0x3FFFFFFF, 0x3FFFFFFFFFFFFFFFull };
+
 size_t picoquic_decode_varint_length(uint8_t byte)
 {
     return ((size_t)1u) << ((byte & 0xC0) >> 6);
@@ -142,7 +147,10 @@ size_t picoquic_varint_decode(const uint8_t* bytes, size_t max_bytes, uint64_t*
     } else {
         length = ((size_t)1) << ((bytes[0] & 0xC0) >> 6);
 
-        if (length > max_bytes) {
+        if (max_bytes >= 8) {
+            *n64 = PICOPARSE_VARINT_8(bytes);
+        }
+        else if (length > max_bytes) {
             *n64 = 0;
             length = 0;
         }
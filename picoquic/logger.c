@@ -24,6 +24,7 @@
 */
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #ifdef _WINDOWS
@@ -37,82 +38,146 @@
 #include "tls_api.h"
 #include "picoquic_unified_log.h"
 
+/* Fast formatting of the most frequent log items. Each item is composed
+ * in a small buffer, and written with a single call instead of a series
+ * of fprintf, which dominate the cost of the text log. */
+typedef struct st_textlog_line_t {
+    size_t length;
+    char text[256];
+} textlog_line_t;
+
+static const char textlog_hex_digits[] = "0123456789abcdef";
+
+static void textlog_line_str(textlog_line_t* line, const char* s)
+{
+    while (*s != 0 && line->length < sizeof(line->text)) {
+        line->text[line->length++] = *s++;
+    }
+}
+
+static void textlog_line_char(textlog_line_t* line, char c)
+{
+    if (line->length < sizeof(line->text)) {
+        line->text[line->length++] = c;
+    }
+}
+
+static void textlog_line_u64(textlog_line_t* line, uint64_t x, int min_digits)
+{
+    char digits[20];
+    int nb_digits = 0;
+
+    do {
+        digits[nb_digits++] = (char)('0' + (x % 10));
+        x /= 10;
+    } while (x > 0 || nb_digits < min_digits);
+
+    while (nb_digits > 0) {
+        textlog_line_char(line, digits[--nb_digits]);
+    }
+}
+
+static void textlog_line_hex64(textlog_line_t* line, uint64_t x, int min_digits)
+{
+    int nb_digits = 16;
+
+    while (nb_digits > min_digits && nb_digits > 1 && (x >> (4 * (nb_digits - 1))) == 0) {
+        nb_digits--;
+    }
+    while (nb_digits > 0) {
+        nb_digits--;
+        textlog_line_char(line, textlog_hex_digits[(x >> (4 * nb_digits)) & 0xF]);
+    }
+}
+
+static void textlog_line_write(FILE* F, const textlog_line_t* line)
+{
+    (void)fwrite(line->text, 1, line->length, F);
+}
+
+static void textlog_line_time(textlog_line_t* line, uint64_t delta_t)
+{
+    textlog_line_u64(line, delta_t / 1000000, 1);
+    textlog_line_char(line, '.');
+    textlog_line_u64(line, delta_t % 1000000, 6);
+}
+
+static void textlog_line_cid64(textlog_line_t* line, uint64_t log_cnxid64)
+{
+    if (log_cnxid64 != 0) {
+        textlog_line_hex64(line, log_cnxid64, 16);
+        textlog_line_str(line, ": ");
+    }
+}
+
 static void textlog_time(FILE* F, picoquic_cnx_t* cnx, uint64_t current_time,
     const char* label1, const char* label2)
 {
-    uint64_t delta_t = (cnx == NULL) ? current_time : current_time - cnx->start_time;
-    uint64_t time_sec = delta_t / 1000000;
-    uint32_t time_usec = (uint32_t)(delta_t % 1000000);
+    textlog_line_t line;
 
-    fprintf(F, "%s%llu.%06d%s", label1,
-        (unsigned long long)time_sec, time_usec, label2);
+    line.length = 0;
+    textlog_line_str(&line, label1);
+    textlog_line_time(&line, (cnx == NULL) ? current_time : current_time - cnx->start_time);
+    textlog_line_str(&line, label2);
+    textlog_line_write(F, &line);
 }
 
 static void textlog_prefix_initial_cid64(FILE* F, uint64_t log_cnxid64)
 {
     if (log_cnxid64 != 0) {
-        fprintf(F, "%016llx: ", (unsigned long long)log_cnxid64);
+        textlog_line_t line;
+
+        line.length = 0;
+        textlog_line_cid64(&line, log_cnxid64);
+        textlog_line_write(F, &line);
     }
 }
 
-static void textlog_address(FILE* F, const struct sockaddr* addr_peer)
+static void textlog_line_address(textlog_line_t* line, const struct sockaddr* addr_peer)
 {
     if (addr_peer->sa_family == AF_INET) {
         struct sockaddr_in* s4 = (struct sockaddr_in*)addr_peer;
         uint8_t* addr = (uint8_t*)&s4->sin_addr;
 
-        fprintf(F, "%d.%d.%d.%d:%d",
-            addr[0], addr[1], addr[2], addr[3],
-            ntohs(s4->sin_port));
+        for (int i = 0; i < 4; i++) {
+            textlog_line_u64(line, addr[i], 1);
+            textlog_line_char(line, (i < 3) ? '.' : ':');
+        }
+        textlog_line_u64(line, ntohs(s4->sin_port), 1);
     }
     else {
         struct sockaddr_in6* s6 = (struct sockaddr_in6*)addr_peer;
         uint8_t* addr = (uint8_t*)&s6->sin6_addr;
 
-        fprintf(F, "[");
+        textlog_line_char(line, '[');
         for (int i = 0; i < 8; i++) {
             if (i != 0) {
-                fprintf(F, ":");
-            }
-
-            if (addr[2 * i] != 0) {
-                fprintf(F, "%x%02x", addr[2 * i], addr[(2 * i) + 1]);
-            }
-            else {
-                fprintf(F, "%x", addr[(2 * i) + 1]);
+                textlog_line_char(line, ':');
             }
+            textlog_line_hex64(line, ((uint64_t)addr[2 * i] << 8) | addr[(2 * i) + 1], 1);
         }
-        fprintf(F, "]:%d", ntohs(s6->sin6_port));
+        textlog_line_str(line, "]:");
+        textlog_line_u64(line, ntohs(s6->sin6_port), 1);
     }
 }
 
 static void textlog_packet_address(FILE* F, uint64_t log_cnxid64, picoquic_cnx_t* cnx,
     const struct sockaddr* addr_peer, int receiving, size_t length, uint64_t current_time)
 {
-    uint64_t delta_t = 0;
-    uint64_t time_sec = 0;
-    uint32_t time_usec = 0;
+    textlog_line_t line;
 
-    textlog_prefix_initial_cid64(F, log_cnxid64);
-
-    fprintf(F, (receiving) ? "Receiving %d bytes from " : "Sending %d bytes to ",
-        (int)length);
-
-    textlog_address(F, addr_peer);
-
-    if (cnx != NULL) {
-        delta_t = current_time - cnx->start_time;
-        time_sec = delta_t / 1000000;
-        time_usec = (uint32_t)(delta_t % 1000000);
-    }
-    else {
-        time_sec = current_time / 1000000;
-        time_usec = (uint32_t)(current_time % 1000000);
-    }
-
-    fprintf(F, " at T=%llu.%06d (%llx)\n",
-        (unsigned long long)time_sec, time_usec,
-        (unsigned long long)current_time);
+    line.length = 0;
+    textlog_line_cid64(&line, log_cnxid64);
+    textlog_line_str(&line, (receiving) ? "Receiving " : "Sending ");
+    textlog_line_u64(&line, length, 1);
+    textlog_line_str(&line, (receiving) ? " bytes from " : " bytes to ");
+    textlog_line_address(&line, addr_peer);
+    textlog_line_str(&line, " at T=");
+    textlog_line_time(&line, (cnx == NULL) ? current_time : current_time - cnx->start_time);
+    textlog_line_str(&line, " (");
+    textlog_line_hex64(&line, current_time, 1);
+    textlog_line_str(&line, ")\n");
+    textlog_line_write(F, &line);
 }
 
 #if 0
@@ -348,6 +413,9 @@ char const* textlog_frame_names(uint64_t frame_type)
     case picoquic_frame_type_observed_address_v6:
         frame_name = "observed_address_v6";
         break;
+    case picoquic_frame_type_fec_repair:
+        frame_name = "fec_repair";
+        break;
     default:
         if (PICOQUIC_IN_RANGE(frame_type, picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
             frame_name = "stream";
@@ -438,6 +506,9 @@ char const* textlog_tp_name(picoquic_tp_enum tp_number)
     case picoquic_tp_enable_bdp_frame:
         tp_name = "enable_bdp_frame";
         break;
+    case picoquic_tp_enable_fec:
+        tp_name = "enable_fec";
+        break;
     case picoquic_tp_initial_max_path_id:
         tp_name = "initial_max_path_id";
         break;
@@ -453,11 +524,15 @@ char const* textlog_tp_name(picoquic_tp_enum tp_number)
 
 static void textlog_connection_id(FILE* F, picoquic_connection_id_t * cid)
 {
-    fprintf(F, "<");
+    textlog_line_t line;
+
+    line.length = 0;
+    textlog_line_char(&line, '<');
     for (uint8_t i = 0; i < cid->id_len; i++) {
-        fprintf(F, "%02x", cid->id[i]);
+        textlog_line_hex64(&line, cid->id[i], 2);
     }
-    fprintf(F, ">");
+    textlog_line_char(&line, '>');
+    textlog_line_write(F, &line);
 }
 
 static void textlog_packet_header(FILE* F, uint64_t log_cnxid64, picoquic_packet_header* ph, int receiving)
@@ -1577,6 +1652,44 @@ size_t textlog_bdp_frame(FILE* F, const uint8_t* bytes, size_t bytes_max)
     return byte_index;
 }
 
+size_t textlog_fec_repair_frame(FILE* F, const uint8_t* bytes, size_t bytes_max)
+{
+    const uint8_t* bytes_end = bytes + bytes_max;
+    const uint8_t* bytes0 = bytes;
+    uint64_t first_pn;
+    uint64_t pn_mask;
+    uint64_t length_xor;
+    uint64_t symbol_length;
+    size_t byte_index = 0;
+
+    if ((bytes = picoquic_frames_varint_skip(bytes, bytes_end)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_end, &first_pn)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_end, &pn_mask)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_end, &length_xor)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_end, &symbol_length)) == NULL ||
+        (bytes = picoquic_frames_fixed_skip(bytes, bytes_end, symbol_length)) == NULL) {
+        fprintf(F, "    Malformed %s frame: ",
+            textlog_frame_names(picoquic_frame_type_fec_repair));
+        /* log format error */
+        for (size_t i = 0; i < bytes_max && i < 8; i++) {
+            fprintf(F, "%02x", bytes0[i]);
+        }
+        if (bytes_max > 8) {
+            fprintf(F, "...");
+        }
+        fprintf(F, "\n");
+        byte_index = bytes_max;
+    }
+    else {
+        fprintf(F, "    %s, first_pn: %" PRIu64 ", mask: 0x%" PRIx64 ", length_xor: %" PRIu64 ", symbol_length: %" PRIu64 "\n",
+            textlog_frame_names(picoquic_frame_type_fec_repair),
+            first_pn, pn_mask, length_xor, symbol_length);
+        byte_index = (bytes - bytes0);
+    }
+
+    return byte_index;
+}
+
 size_t textlog_observed_address_frame(FILE* F, const uint8_t* bytes, size_t byte_size, uint64_t frame_id)
 {
     size_t bytes_index = byte_size;
@@ -1778,6 +1891,9 @@ void picoquic_textlog_frames(FILE* F, uint64_t cnx_id64, const uint8_t* bytes, s
         case picoquic_frame_type_observed_address_v6:
             byte_index += textlog_observed_address_frame(F, bytes + byte_index, length - byte_index, frame_id);
             break;
+        case picoquic_frame_type_fec_repair:
+            byte_index += textlog_fec_repair_frame(F, bytes + byte_index, length - byte_index);
+            break;
         default: {
             /* Not implemented yet! */
             fprintf(F, "    Unknown frame, type: %" PRIu64 " (0x", frame_id);
@@ -2251,6 +2367,74 @@ void picoquic_textlog_picotls_ticket(FILE* F, picoquic_connection_id_t cnx_id,
  * so the call the log_app_message writes on both log file and binlog */
 void picoquic_binlog_message_v(picoquic_cnx_t* cnx, const char* fmt, va_list vargs);
 
+/* The asynchronous writer is defined in logwriter.c. When the text log uses
+ * it, F_log is a memory stream over textlog_buffer, and the text of each
+ * event is passed to the writer thread once formatted. */
+int picoquic_textlog_async_write(picoquic_quic_t* quic, FILE* f, const uint8_t* data, size_t length);
+void picoquic_textlog_async_release(picoquic_quic_t* quic, FILE* f);
+
+#define PICOQUIC_TEXTLOG_BUFFER_SIZE 0x10000
+
+static void textlog_async_flush(picoquic_quic_t* quic)
+{
+    if (quic->F_textlog_file != NULL) {
+        FILE* F = (FILE*)quic->F_log;
+        long length;
+
+        (void)fflush(F);
+        length = ftell(F);
+        if (length > 0) {
+            (void)picoquic_textlog_async_write(quic, (FILE*)quic->F_textlog_file,
+                (const uint8_t*)quic->textlog_buffer, (size_t)length);
+        }
+        rewind(F);
+    }
+}
+
+static void textlog_suppressed_events(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    if (cnx->textlog_nb_suppressed > 0) {
+        FILE* F = (FILE*)cnx->quic->F_log;
+
+        textlog_prefix_initial_cid64(F, picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx)));
+        textlog_time(F, cnx, current_time, "T= ", ", ");
+        fprintf(F, "%" PRIu64 " log events suppressed by the rate limit.\n", cnx->textlog_nb_suppressed);
+        cnx->textlog_nb_suppressed = 0;
+    }
+}
+
+/* If the text log is rate limited, only the first events of each one second
+ * window are logged, and the number of events suppressed is logged when
+ * the next window starts. */
+static int textlog_cnx_rate_check(picoquic_cnx_t* cnx)
+{
+    int is_logging = 1;
+
+    if (cnx->quic->textlog_max_lines_per_second > 0) {
+        uint64_t current_time = picoquic_get_quic_time(cnx->quic);
+
+        if (current_time >= cnx->textlog_window_start + 1000000) {
+            textlog_suppressed_events(cnx, current_time);
+            cnx->textlog_window_start = current_time;
+            cnx->textlog_window_lines = 0;
+        }
+        if (cnx->textlog_window_lines < cnx->quic->textlog_max_lines_per_second) {
+            cnx->textlog_window_lines++;
+        }
+        else {
+            cnx->textlog_nb_suppressed++;
+            is_logging = 0;
+        }
+    }
+
+    return is_logging;
+}
+
+static int textlog_cnx_is_logging(picoquic_cnx_t* cnx)
+{
+    return cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx) && textlog_cnx_rate_check(cnx);
+}
+
 void picoquic_txtlog_message_v(picoquic_quic_t* quic, const picoquic_connection_id_t* cid, const char* fmt, va_list vargs)
 {
     FILE* F = quic->F_log;
@@ -2269,13 +2453,15 @@ void txtlog_context_free_app_message(picoquic_quic_t* quic, const picoquic_conne
 {
     if (quic->F_log != NULL) {
         picoquic_txtlog_message_v(quic, cid, fmt, vargs);
+        textlog_async_flush(quic);
     }
 }
 
 static void textlog_app_message(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (cnx->quic->F_log != NULL && textlog_cnx_rate_check(cnx)) {
         picoquic_txtlog_message_v(cnx->quic, &cnx->initial_cnxid, fmt, vargs);
+        textlog_async_flush(cnx->quic);
     }
 }
 
@@ -2289,6 +2475,7 @@ static void textlog_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t curr
     if (quic->F_log != NULL) {
         textlog_packet_address(quic->F_log, cid64,
             NULL, addr_peer, receiving, packet_length, current_time);
+        textlog_async_flush(quic);
     }
 }
 
@@ -2300,39 +2487,43 @@ static void textlog_pdu_ex(picoquic_cnx_t* cnx, int receiving, uint64_t current_
     UNREFERENCED_PARAMETER(addr_local);
     UNREFERENCED_PARAMETER(unique_path_id);
 #endif
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         textlog_packet_address(cnx->quic->F_log,
             picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx)),
             cnx, addr_peer, receiving, packet_length, current_time);
+        textlog_async_flush(cnx->quic);
     }
 }
 
 static void textlog_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int receiving, uint64_t current_time,
     picoquic_packet_header* ph, const uint8_t* bytes, size_t bytes_max)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         textlog_decrypted_segment(cnx->quic->F_log, 1, 
             cnx, receiving, ph, bytes, bytes_max, 0);
+        textlog_async_flush(cnx->quic);
     }
 }
 
 static void textlog_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_header* ph,
     size_t packet_size, int ret, uint8_t* raw_data, uint64_t current_time)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         textlog_decrypted_segment(cnx->quic->F_log, 1, cnx, 1, ph, raw_data, packet_size, ret);
+        textlog_async_flush(cnx->quic);
     }
 }
 
 static void textlog_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     picoquic_packet_type_enum ptype, uint64_t current_time)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         FILE* F = cnx->quic->F_log;
 
         fprintf(F, "%" PRIx64 ": ", picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx)));
         textlog_time(F, cnx, current_time, "T= ", ", ");
         fprintf(F, "Keys unavailable, buffered packet type %d.\n", ptype);
+        textlog_async_flush(cnx->quic);
     }
 }
 
@@ -2340,9 +2531,10 @@ static void textlog_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t * path_
     uint8_t* bytes, uint64_t sequence_number, size_t pn_length, size_t length,
     uint8_t* send_buffer, size_t send_length, uint64_t current_time)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         textlog_outgoing_segment(cnx->quic->F_log, 1,
             cnx, bytes, sequence_number, length, send_buffer, send_length, pn_length);
+        textlog_async_flush(cnx->quic);
     }
 }
 
@@ -2351,7 +2543,7 @@ static void textlog_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     picoquic_connection_id_t* dcid, size_t packet_size,
     uint64_t current_time)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         FILE* F = cnx->quic->F_log;
 
         fprintf(F, "%" PRIx64 ": ", picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx)));
@@ -2362,6 +2554,7 @@ static void textlog_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
             textlog_connection_id(F, dcid);
         }
         fprintf(F, ", reason: %s\n", trigger);
+        textlog_async_flush(cnx->quic);
     }
 }
 
@@ -2377,10 +2570,11 @@ static void textlog_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
     UNREFERENCED_PARAMETER(alpn_list);
     UNREFERENCED_PARAMETER(alpn_count);
 #endif
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         /* TODO: alpn */
         picoquic_textlog_negotiated_alpn(cnx->quic->F_log, cnx, 
             (is_local) ? 0 : 1, 1, alpn_list, alpn_count);
+        textlog_async_flush(cnx->quic);
     }
 }
 
@@ -2388,17 +2582,19 @@ static void textlog_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
 static void textlog_transport_extension(picoquic_cnx_t* cnx, int is_local,
     size_t param_length, uint8_t* params)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         /* TODO: alpn */
         picoquic_textlog_transport_extension(cnx->quic->F_log, cnx, (is_local)?0:1, 1, params, param_length);
+        textlog_async_flush(cnx->quic);
     }
 }
 
 static void textlog_tls_ticket(picoquic_cnx_t* cnx, uint8_t* ticket, uint16_t ticket_length)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         picoquic_textlog_picotls_ticket(cnx->quic->F_log, picoquic_get_logging_cnxid(cnx),
             ticket, ticket_length);
+        textlog_async_flush(cnx->quic);
     }
 }
 
@@ -2411,22 +2607,37 @@ static void textlog_new_connection(picoquic_cnx_t* cnx)
 
 static void textlog_close_connection(picoquic_cnx_t* cnx)
 {
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(cnx);
-#endif
+    /* Do not lose the count of the last rate limited events */
+    if (cnx->quic->F_log != NULL && cnx->textlog_nb_suppressed > 0) {
+        textlog_suppressed_events(cnx, picoquic_get_quic_time(cnx->quic));
+        textlog_async_flush(cnx->quic);
+    }
 }
 
 static void textlog_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
 {
-    if (cnx->quic->F_log != NULL && picoquic_cnx_is_still_logging(cnx)) {
+    if (textlog_cnx_is_logging(cnx)) {
         textlog_congestion_state(cnx->quic->F_log, cnx, current_time);
+        textlog_async_flush(cnx->quic);
     }
 }
 
 
 void picoquic_textlog_close(picoquic_quic_t* quic)
 {
-    if (quic->F_log != NULL && quic->should_close_log) {
+    if (quic->F_textlog_file != NULL) {
+        /* The file is closed by the writer thread, after the last records */
+        textlog_async_flush(quic);
+        (void)picoquic_file_close((FILE*)quic->F_log);
+        quic->F_log = quic->F_textlog_file;
+        quic->F_textlog_file = NULL;
+        free(quic->textlog_buffer);
+        quic->textlog_buffer = NULL;
+        if (quic->should_close_log) {
+            picoquic_textlog_async_release(quic, (FILE*)quic->F_log);
+        }
+    }
+    else if (quic->F_log != NULL && quic->should_close_log) {
         (void)picoquic_file_close(quic->F_log);
     }
 
@@ -2458,10 +2669,18 @@ struct st_picoquic_unified_logging_t textlog_functions = {
 int picoquic_set_textlog(picoquic_quic_t* quic, char const* textlog_file)
 {
     int ret = 0;
+#ifndef PICOQUIC_LEAN
     FILE* F_log;
+#endif
 
     picoquic_textlog_close(quic);
 
+#ifdef PICOQUIC_LEAN
+    if (textlog_file != NULL) {
+        DBG_PRINTF("%s", "The text log is not available in the lean build");
+        ret = -1;
+    }
+#else
     if (textlog_file != NULL) {
         if (strcmp(textlog_file, "-") == 0) {
             quic->F_log = stdout;
@@ -2474,6 +2693,8 @@ int picoquic_set_textlog(picoquic_quic_t* quic, char const* textlog_file)
                 ret = -1;
             }
             else {
+                /* A large buffer, so the log is written in big chunks */
+                (void)setvbuf(F_log, NULL, _IOFBF, PICOQUIC_TEXTLOG_BUFFER_SIZE);
                 quic->F_log = F_log;
                 quic->should_close_log = 1;
             }
@@ -2481,6 +2702,48 @@ int picoquic_set_textlog(picoquic_quic_t* quic, char const* textlog_file)
 
         quic->text_log_fns = &textlog_functions;
     }
+#endif
+
+    return ret;
+}
+
+void picoquic_set_textlog_rate_limit(picoquic_quic_t* quic, uint64_t max_lines_per_second)
+{
+    quic->textlog_max_lines_per_second = max_lines_per_second;
+}
+
+int picoquic_set_textlog_async(picoquic_quic_t* quic)
+{
+    int ret = 0;
+
+#ifdef _WINDOWS
+    /* There are no memory streams in the Windows C library */
+    UNREFERENCED_PARAMETER(quic);
+    ret = -1;
+#else
+    if (quic->F_log == NULL || quic->binlog_async == NULL || quic->F_textlog_file != NULL) {
+        ret = -1;
+    }
+    else if ((quic->textlog_buffer = (char*)malloc(PICOQUIC_TEXTLOG_BUFFER_SIZE)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        FILE* F_mem = fmemopen(quic->textlog_buffer, PICOQUIC_TEXTLOG_BUFFER_SIZE, "w");
+
+        if (F_mem == NULL) {
+            DBG_PRINTF("%s", "Cannot create the text log memory stream");
+            free(quic->textlog_buffer);
+            quic->textlog_buffer = NULL;
+            ret = -1;
+        }
+        else {
+            /* Records written so far go first */
+            (void)fflush((FILE*)quic->F_log);
+            quic->F_textlog_file = quic->F_log;
+            quic->F_log = F_mem;
+        }
+    }
+#endif
 
     return ret;
 }
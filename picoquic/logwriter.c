@@ -24,12 +24,748 @@
 */
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include "picoquic_binlog.h"
 #include "bytestream.h"
 #include "tls_api.h"
 #include "picotls.h"
 #include "picoquic_unified_log.h"
-#include "picoquic_binlog.h"
+#include "picoquic_set_binlog.h"
+#include "picoquic_utils.h"
+
+/*
+ * Binlog records are composed in memory before being written, so that each
+ * record reaches the file, or the asynchronous writer, in a single piece.
+ * Records start in an inline buffer, which is sufficient for most events,
+ * and move to the heap if needed, e.g., for packets with many small frames.
+ */
+#define BINLOG_RECORD_INLINE_SIZE 2048
+
+typedef struct st_binlog_record_t {
+    uint8_t* data;
+    size_t length;
+    size_t size;
+    int is_error;
+    int is_reserved; /* The data is reserved in the asynchronous ring, and cannot grow */
+    uint8_t inline_data[BINLOG_RECORD_INLINE_SIZE];
+} binlog_record_t;
+
+static void binlog_record_init(binlog_record_t* r)
+{
+    r->data = r->inline_data;
+    r->length = 0;
+    r->size = BINLOG_RECORD_INLINE_SIZE;
+    r->is_error = 0;
+    r->is_reserved = 0;
+}
+
+static void binlog_record_release(binlog_record_t* r)
+{
+    if (r->data != r->inline_data && !r->is_reserved) {
+        free(r->data);
+    }
+    binlog_record_init(r);
+}
+
+/* Make room for at least "needed" more bytes, and return the write position,
+ * or NULL if the room cannot be found. */
+static uint8_t* binlog_record_room(binlog_record_t* r, size_t needed)
+{
+    if (!r->is_error && r->length + needed > r->size) {
+        size_t new_size = 2 * r->size;
+        uint8_t* new_data = NULL;
+
+        while (new_size < r->length + needed) {
+            new_size *= 2;
+        }
+        /* Reserved records cannot grow: the maximum size computed for the record was wrong */
+        if (r->is_reserved || (new_data = (uint8_t*)malloc(new_size)) == NULL) {
+            r->is_error = 1;
+        }
+        else {
+            memcpy(new_data, r->data, r->length);
+            if (r->data != r->inline_data) {
+                free(r->data);
+            }
+            r->data = new_data;
+            r->size = new_size;
+        }
+    }
+
+    return (r->is_error) ? NULL : r->data + r->length;
+}
+
+static void binlog_record_append(binlog_record_t* r, const void* bytes, size_t length)
+{
+    uint8_t* next = binlog_record_room(r, length);
+
+    if (next != NULL) {
+        memcpy(next, bytes, length);
+        r->length += length;
+    }
+}
+
+/*
+ * Asynchronous binlog writer.
+ *
+ * The network thread appends the records to a ring buffer owned by the
+ * QUIC context, and a writer thread copies them to the files. There is a
+ * single producer and a single consumer. Each side owns its own index, and
+ * the producer keeps a cached copy of the reader index, so the mutex is only
+ * taken to publish new records, or to refresh the cached index when the ring
+ * looks full. Disk and stdio operations only happen in the writer thread.
+ *
+ * Files are still opened by the network thread, but they are closed by the
+ * writer thread after their last record. When the ring is full, the records
+ * are either dropped or the network thread waits, depending on the policy.
+ * Control records, such as file closures, are never dropped.
+ *
+ * The most frequent records, packets and congestion control updates, are
+ * encoded in place: the producer reserves room for the maximum size of the
+ * record, contiguous in the ring, encodes the record there, and commits
+ * the actual length. If the room would wrap around the end of the ring, a
+ * skip record fills the end of the ring. If there is no room, the record
+ * is composed in memory and queued as usual, which applies the policy.
+ */
+#define PICOQUIC_BINLOG_ASYNC_RING_DEFAULT 0x100000
+#define PICOQUIC_BINLOG_ASYNC_WAIT_USEC 10000
+
+typedef enum {
+    picoquic_binlog_async_op_write = 0,
+    picoquic_binlog_async_op_close,
+    picoquic_binlog_async_op_block, /* Compress the record as a block, see binlog_block.c */
+    picoquic_binlog_async_op_qlog, /* Pass the record to the streaming qlog */
+    picoquic_binlog_async_op_qlog_close,
+    picoquic_binlog_async_op_skip /* Unused space before a record encoded in place */
+} picoquic_binlog_async_op_enum;
+
+typedef struct st_picoquic_binlog_async_header_t {
+    FILE* f;
+    picoquic_qlog_stream_t* qlog_stream;
+    size_t length;
+    picoquic_binlog_async_op_enum op;
+} picoquic_binlog_async_header_t;
+
+typedef struct st_picoquic_binlog_async_t {
+    picoquic_mutex_t mutex;
+    picoquic_event_t data_event;
+    picoquic_event_t space_event;
+    picoquic_thread_t thread;
+    uint8_t* ring;
+    size_t ring_size;
+    uint64_t write_index; /* Updated by the producer, under lock */
+    uint64_t read_index; /* Updated by the writer, under lock */
+    uint64_t cached_read_index; /* Producer copy of read_index */
+    uint64_t reserved_index; /* Position of the record reserved by the producer */
+    picoquic_binlog_async_policy_enum policy;
+    picoquic_binlog_async_stats_t stats;
+    int should_close; /* Set under lock when the context is freed */
+    uint8_t* block_buffer; /* Used by the writer, for records that wrap around the ring */
+    size_t block_buffer_size;
+} picoquic_binlog_async_t;
+
+static void binlog_async_ring_write(picoquic_binlog_async_t* ba, uint64_t index, const void* data, size_t length)
+{
+    size_t offset = (size_t)(index & (ba->ring_size - 1));
+    size_t first = ba->ring_size - offset;
+
+    if (first >= length) {
+        memcpy(ba->ring + offset, data, length);
+    }
+    else {
+        memcpy(ba->ring + offset, data, first);
+        memcpy(ba->ring, ((const uint8_t*)data) + first, length - first);
+    }
+}
+
+static void binlog_async_ring_read(picoquic_binlog_async_t* ba, uint64_t index, void* data, size_t length)
+{
+    size_t offset = (size_t)(index & (ba->ring_size - 1));
+    size_t first = ba->ring_size - offset;
+
+    if (first >= length) {
+        memcpy(data, ba->ring + offset, length);
+    }
+    else {
+        memcpy(data, ba->ring + offset, first);
+        memcpy(((uint8_t*)data) + first, ba->ring, length - first);
+    }
+}
+
+/* Called by the writer. Returns the record as a single piece, copied in the
+ * block buffer if it wraps around the ring, or NULL if memory is missing. */
+static const uint8_t* binlog_async_record_data(picoquic_binlog_async_t* ba, uint64_t read_index, size_t length)
+{
+    size_t offset = (size_t)(read_index & (ba->ring_size - 1));
+    const uint8_t* data = NULL;
+
+    if (ba->ring_size - offset >= length) {
+        data = ba->ring + offset;
+    }
+    else {
+        if (ba->block_buffer_size < length) {
+            free(ba->block_buffer);
+            ba->block_buffer_size = 0;
+            if ((ba->block_buffer = (uint8_t*)malloc(length)) != NULL) {
+                ba->block_buffer_size = length;
+            }
+        }
+        if (ba->block_buffer != NULL) {
+            binlog_async_ring_read(ba, read_index, ba->block_buffer, length);
+            data = ba->block_buffer;
+        }
+    }
+
+    return data;
+}
+
+static picoquic_thread_return_t binlog_async_writer_thread(void* v_ba)
+{
+    picoquic_binlog_async_t* ba = (picoquic_binlog_async_t*)v_ba;
+
+    while (1) {
+        uint64_t read_index;
+        uint64_t write_index;
+        int should_close;
+
+        picoquic_lock_mutex(&ba->mutex);
+        read_index = ba->read_index;
+        write_index = ba->write_index;
+        should_close = ba->should_close;
+        picoquic_unlock_mutex(&ba->mutex);
+
+        if (read_index == write_index) {
+            if (should_close) {
+                break;
+            }
+            (void)picoquic_wait_for_event(&ba->data_event, PICOQUIC_BINLOG_ASYNC_WAIT_USEC);
+            continue;
+        }
+
+        /* Write all the records published so far, then release the space */
+        while (read_index < write_index) {
+            picoquic_binlog_async_header_t header;
+
+            binlog_async_ring_read(ba, read_index, &header, sizeof(header));
+            read_index += sizeof(header);
+            if (header.op == picoquic_binlog_async_op_skip) {
+                read_index += header.length;
+            }
+            else if (header.op == picoquic_binlog_async_op_close) {
+                (void)picoquic_file_close(header.f);
+            }
+            else if (header.op == picoquic_binlog_async_op_qlog_close) {
+                header.qlog_stream->close_fn(header.qlog_stream);
+            }
+            else if (header.op == picoquic_binlog_async_op_block || header.op == picoquic_binlog_async_op_qlog) {
+                const uint8_t* data = binlog_async_record_data(ba, read_index, header.length);
+
+                if (data != NULL) {
+                    if (header.op == picoquic_binlog_async_op_block) {
+                        (void)picoquic_binlog_block_write(header.f, data, header.length);
+                    }
+                    else {
+                        header.qlog_stream->record_fn(header.qlog_stream, data, header.length);
+                    }
+                }
+                read_index += header.length;
+            }
+            else {
+                size_t offset = (size_t)(read_index & (ba->ring_size - 1));
+                size_t first = ba->ring_size - offset;
+
+                if (first >= header.length) {
+                    (void)fwrite(ba->ring + offset, 1, header.length, header.f);
+                }
+                else {
+                    (void)fwrite(ba->ring + offset, 1, first, header.f);
+                    (void)fwrite(ba->ring, 1, header.length - first, header.f);
+                }
+                read_index += header.length;
+            }
+        }
+
+        picoquic_lock_mutex(&ba->mutex);
+        ba->read_index = read_index;
+        picoquic_unlock_mutex(&ba->mutex);
+        (void)picoquic_signal_event(&ba->space_event);
+    }
+
+    picoquic_thread_do_return;
+}
+
+static uint64_t binlog_async_refresh_read_index(picoquic_binlog_async_t* ba)
+{
+    picoquic_lock_mutex(&ba->mutex);
+    ba->cached_read_index = ba->read_index;
+    picoquic_unlock_mutex(&ba->mutex);
+
+    return ba->cached_read_index;
+}
+
+/* Called on the network thread. Returns 0 if the record was queued. */
+static int binlog_async_push_ex(picoquic_binlog_async_t* ba, FILE* f, picoquic_qlog_stream_t* qlog_stream,
+    picoquic_binlog_async_op_enum op, const uint8_t* data1, size_t length1, const uint8_t* data2, size_t length2)
+{
+    int ret = 0;
+    picoquic_binlog_async_header_t header;
+    size_t needed = sizeof(header) + length1 + length2;
+    uint64_t fill = ba->write_index - ba->cached_read_index;
+
+    if (ba->ring_size - fill < needed) {
+        fill = ba->write_index - binlog_async_refresh_read_index(ba);
+    }
+    if (ba->ring_size - fill < needed) {
+        if (needed > ba->ring_size ||
+            (ba->policy == picoquic_binlog_async_drop && op != picoquic_binlog_async_op_close &&
+                op != picoquic_binlog_async_op_qlog_close)) {
+            ba->stats.nb_records_dropped++;
+            ba->stats.nb_bytes_dropped += length1 + length2;
+            ret = -1;
+        }
+        else {
+            /* Back pressure: wait until the writer makes room */
+            ba->stats.nb_producer_waits++;
+            while (ba->ring_size - fill < needed) {
+                (void)picoquic_signal_event(&ba->data_event);
+                (void)picoquic_wait_for_event(&ba->space_event, PICOQUIC_BINLOG_ASYNC_WAIT_USEC);
+                fill = ba->write_index - binlog_async_refresh_read_index(ba);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        memset(&header, 0, sizeof(header));
+        header.f = f;
+        header.qlog_stream = qlog_stream;
+        header.length = length1 + length2;
+        header.op = op;
+        binlog_async_ring_write(ba, ba->write_index, &header, sizeof(header));
+        if (length1 > 0) {
+            binlog_async_ring_write(ba, ba->write_index + sizeof(header), data1, length1);
+        }
+        if (length2 > 0) {
+            binlog_async_ring_write(ba, ba->write_index + sizeof(header) + length1, data2, length2);
+        }
+        picoquic_lock_mutex(&ba->mutex);
+        ba->write_index += needed;
+        picoquic_unlock_mutex(&ba->mutex);
+        (void)picoquic_signal_event(&ba->data_event);
+
+        ba->stats.nb_records++;
+        ba->stats.nb_bytes += length1 + length2;
+        if (fill + needed > ba->stats.max_ring_fill) {
+            ba->stats.max_ring_fill = fill + needed;
+        }
+    }
+
+    return ret;
+}
+
+static int binlog_async_push(picoquic_binlog_async_t* ba, FILE* f, picoquic_binlog_async_op_enum op,
+    const uint8_t* data1, size_t length1, const uint8_t* data2, size_t length2)
+{
+    return binlog_async_push_ex(ba, f, NULL, op, data1, length1, data2, length2);
+}
+
+/* Called on the network thread. Returns room for a record of up to max_length
+ * bytes, contiguous in the ring, or NULL if that room is not available now.
+ * The record becomes visible to the writer when binlog_async_commit is called.
+ * Reservations are not nested, and the producer does not push other records
+ * before the commit. */
+static uint8_t* binlog_async_reserve(picoquic_binlog_async_t* ba, size_t max_length)
+{
+    uint8_t* data = NULL;
+    size_t h = sizeof(picoquic_binlog_async_header_t);
+    size_t data_offset = (size_t)((ba->write_index + h) & (ba->ring_size - 1));
+    size_t skip = 0;
+    uint64_t fill = ba->write_index - ba->cached_read_index;
+
+    if (data_offset + max_length > ba->ring_size) {
+        /* Skip to the end of the ring, so that the data of the record starts at offset 0 */
+        skip = h + (size_t)((ba->ring_size - ((ba->write_index + 2 * h) & (ba->ring_size - 1))) & (ba->ring_size - 1));
+    }
+    if (skip + h + max_length <= ba->ring_size) {
+        if (ba->ring_size - fill < skip + h + max_length) {
+            fill = ba->write_index - binlog_async_refresh_read_index(ba);
+        }
+        if (ba->ring_size - fill >= skip + h + max_length) {
+            if (skip > 0) {
+                picoquic_binlog_async_header_t header;
+
+                memset(&header, 0, sizeof(header));
+                header.length = skip - h;
+                header.op = picoquic_binlog_async_op_skip;
+                binlog_async_ring_write(ba, ba->write_index, &header, sizeof(header));
+            }
+            ba->reserved_index = ba->write_index + skip;
+            data = ba->ring + ((ba->reserved_index + h) & (ba->ring_size - 1));
+        }
+    }
+
+    return data;
+}
+
+static void binlog_async_commit(picoquic_binlog_async_t* ba, FILE* f, size_t length)
+{
+    picoquic_binlog_async_header_t header;
+    uint64_t needed = ba->reserved_index + sizeof(header) + length - ba->write_index;
+    uint64_t fill = ba->write_index - ba->cached_read_index;
+
+    memset(&header, 0, sizeof(header));
+    header.f = f;
+    header.length = length;
+    header.op = picoquic_binlog_async_op_write;
+    binlog_async_ring_write(ba, ba->reserved_index, &header, sizeof(header));
+    picoquic_lock_mutex(&ba->mutex);
+    ba->write_index += needed;
+    picoquic_unlock_mutex(&ba->mutex);
+    (void)picoquic_signal_event(&ba->data_event);
+
+    ba->stats.nb_records++;
+    ba->stats.nb_records_direct++;
+    ba->stats.nb_bytes += length;
+    if (fill + needed > ba->stats.max_ring_fill) {
+        ba->stats.max_ring_fill = fill + needed;
+    }
+}
+
+/* Wait until the writer thread has processed all the queued records */
+static void binlog_async_drain(picoquic_binlog_async_t* ba)
+{
+    while (binlog_async_refresh_read_index(ba) < ba->write_index) {
+        (void)picoquic_signal_event(&ba->data_event);
+        (void)picoquic_wait_for_event(&ba->space_event, PICOQUIC_BINLOG_ASYNC_WAIT_USEC);
+    }
+}
+
+static void binlog_async_delete(picoquic_binlog_async_t* ba)
+{
+    picoquic_lock_mutex(&ba->mutex);
+    ba->should_close = 1;
+    picoquic_unlock_mutex(&ba->mutex);
+    (void)picoquic_signal_event(&ba->data_event);
+    (void)picoquic_wait_thread(ba->thread);
+    picoquic_delete_thread(&ba->thread);
+    picoquic_delete_event(&ba->data_event);
+    picoquic_delete_event(&ba->space_event);
+    (void)picoquic_delete_mutex(&ba->mutex);
+    free(ba->block_buffer);
+    free(ba->ring);
+    free(ba);
+}
+
+static picoquic_binlog_async_t* binlog_async_create(size_t ring_size, picoquic_binlog_async_policy_enum policy)
+{
+    picoquic_binlog_async_t* ba = (picoquic_binlog_async_t*)malloc(sizeof(picoquic_binlog_async_t));
+    size_t size = 4096;
+
+    while (size < ring_size) {
+        size *= 2;
+    }
+
+    if (ba != NULL) {
+        memset(ba, 0, sizeof(picoquic_binlog_async_t));
+        ba->ring_size = size;
+        ba->policy = policy;
+        if ((ba->ring = (uint8_t*)malloc(size)) == NULL) {
+            free(ba);
+            ba = NULL;
+        }
+        else if (picoquic_create_mutex(&ba->mutex) != 0) {
+            free(ba->ring);
+            free(ba);
+            ba = NULL;
+        }
+        else if (picoquic_create_event(&ba->data_event) != 0 || picoquic_create_event(&ba->space_event) != 0 ||
+            picoquic_create_thread(&ba->thread, binlog_async_writer_thread, ba) != 0) {
+            DBG_PRINTF("%s", "Cannot start the binlog writer thread");
+            picoquic_delete_event(&ba->data_event);
+            picoquic_delete_event(&ba->space_event);
+            (void)picoquic_delete_mutex(&ba->mutex);
+            free(ba->ring);
+            free(ba);
+            ba = NULL;
+        }
+    }
+
+    return ba;
+}
+
+/*
+ * Compressed blocks. The records of the connection are accumulated in
+ * memory, and the block is written when it reaches the block size, or
+ * when the log file is closed. With the asynchronous writer, the block
+ * is queued as a single record and compressed by the writer thread.
+ */
+typedef struct st_picoquic_binlog_block_t {
+    uint8_t* data;
+    size_t length;
+    size_t size;
+    size_t threshold; /* Write the block when the length reaches that value */
+} picoquic_binlog_block_t;
+
+#define PICOQUIC_BINLOG_BLOCK_SIZE_MIN 0x1000
+#define PICOQUIC_BINLOG_BLOCK_SIZE_MAX 0x100000
+
+static void binlog_block_flush(picoquic_cnx_t* cnx)
+{
+    picoquic_binlog_block_t* b = cnx->binlog_block;
+
+    if (b != NULL && b->length > 0 && cnx->f_binlog != NULL) {
+        if (cnx->quic->binlog_async != NULL) {
+            (void)binlog_async_push(cnx->quic->binlog_async, cnx->f_binlog, picoquic_binlog_async_op_block,
+                b->data, b->length, NULL, 0);
+        }
+        else {
+            (void)picoquic_binlog_block_write(cnx->f_binlog, b->data, b->length);
+        }
+        b->length = 0;
+    }
+}
+
+static int binlog_block_create(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+    picoquic_binlog_block_t* b = (picoquic_binlog_block_t*)malloc(sizeof(picoquic_binlog_block_t));
+
+    if (b == NULL) {
+        ret = -1;
+    }
+    else {
+        b->length = 0;
+        b->threshold = cnx->quic->binlog_block_size;
+        if (cnx->quic->binlog_async != NULL && b->threshold > cnx->quic->binlog_async->ring_size / 4) {
+            /* Blocks larger than the ring would always be dropped */
+            b->threshold = cnx->quic->binlog_async->ring_size / 4;
+        }
+        /* Leave room for the record that crosses the threshold */
+        b->size = b->threshold + BYTESTREAM_MAX_BUFFER_SIZE + 4;
+        if ((b->data = (uint8_t*)malloc(b->size)) == NULL) {
+            free(b);
+            ret = -1;
+        }
+        else {
+            cnx->binlog_block = b;
+        }
+    }
+
+    return ret;
+}
+
+static void binlog_block_free(picoquic_cnx_t* cnx)
+{
+    if (cnx->binlog_block != NULL) {
+        binlog_block_flush(cnx);
+        free(cnx->binlog_block->data);
+        free(cnx->binlog_block);
+        cnx->binlog_block = NULL;
+    }
+}
+
+static void binlog_block_append(picoquic_cnx_t* cnx, const uint8_t* data1, size_t length1,
+    const uint8_t* data2, size_t length2)
+{
+    picoquic_binlog_block_t* b = cnx->binlog_block;
+
+    if (b->length + length1 + length2 > b->size) {
+        binlog_block_flush(cnx);
+        if (length1 + length2 > b->size) {
+            /* Larger than usual record, e.g., packet with many frames */
+            uint8_t* new_data = (uint8_t*)malloc(length1 + length2);
+
+            if (new_data == NULL) {
+                return;
+            }
+            free(b->data);
+            b->data = new_data;
+            b->size = length1 + length2;
+        }
+    }
+    if (length1 > 0) {
+        memcpy(b->data + b->length, data1, length1);
+    }
+    if (length2 > 0) {
+        memcpy(b->data + b->length + length1, data2, length2);
+    }
+    b->length += length1 + length2;
+    if (b->length >= b->threshold) {
+        binlog_block_flush(cnx);
+    }
+}
+
+static void binlog_recorder_append(picoquic_cnx_t* cnx, const uint8_t* data1, size_t length1,
+    const uint8_t* data2, size_t length2);
+static void binlog_policy_check_names(picoquic_cnx_t* cnx, uint8_t const* sni, size_t sni_len,
+    uint8_t const* alpn, size_t alpn_len);
+
+/* Pass the record to the streaming qlog. The record starts with the 4 bytes
+ * length prefix, normally in the first part. */
+static void binlog_qlog_stream_write(picoquic_cnx_t* cnx, const uint8_t* data1, size_t length1,
+    const uint8_t* data2, size_t length2)
+{
+    if (length1 >= 4) {
+        data1 += 4;
+        length1 -= 4;
+    }
+    else {
+        return;
+    }
+
+    if (cnx->quic->binlog_async != NULL) {
+        (void)binlog_async_push_ex(cnx->quic->binlog_async, NULL, cnx->qlog_stream, picoquic_binlog_async_op_qlog,
+            data1, length1, data2, length2);
+    }
+    else if (length2 == 0) {
+        cnx->qlog_stream->record_fn(cnx->qlog_stream, data1, length1);
+    }
+    else if (length1 == 0) {
+        cnx->qlog_stream->record_fn(cnx->qlog_stream, data2, length2);
+    }
+    else {
+        binlog_record_t r;
+
+        binlog_record_init(&r);
+        binlog_record_append(&r, data1, length1);
+        binlog_record_append(&r, data2, length2);
+        if (!r.is_error) {
+            cnx->qlog_stream->record_fn(cnx->qlog_stream, r.data, r.length);
+        }
+        binlog_record_release(&r);
+    }
+}
+
+/* Close the streaming qlog after its last record */
+static void binlog_qlog_stream_release(picoquic_cnx_t* cnx)
+{
+    if (cnx->qlog_stream != NULL) {
+        if (cnx->quic->binlog_async != NULL) {
+            (void)binlog_async_push_ex(cnx->quic->binlog_async, NULL, cnx->qlog_stream, picoquic_binlog_async_op_qlog_close,
+                NULL, 0, NULL, 0);
+        }
+        else {
+            cnx->qlog_stream->close_fn(cnx->qlog_stream);
+        }
+        cnx->qlog_stream = NULL;
+    }
+}
+
+/* Write a record to a log file, directly or through the asynchronous writer,
+ * or keep it in memory if the connection uses a flight recorder. If the
+ * connection uses a streaming qlog, the records of its log file are also
+ * passed to the stream, and there may not be a log file at all. */
+static void binlog_write(picoquic_cnx_t* cnx, FILE* f, const uint8_t* data1, size_t length1,
+    const uint8_t* data2, size_t length2)
+{
+    if (cnx != NULL && cnx->qlog_stream != NULL && f == cnx->f_binlog) {
+        binlog_qlog_stream_write(cnx, data1, length1, data2, length2);
+        if (f == NULL) {
+            return;
+        }
+    }
+
+    if (cnx != NULL && cnx->binlog_recorder != NULL) {
+        binlog_recorder_append(cnx, data1, length1, data2, length2);
+    }
+    else if (cnx != NULL && cnx->binlog_block != NULL && f == cnx->f_binlog) {
+        binlog_block_append(cnx, data1, length1, data2, length2);
+    }
+    else if (cnx != NULL && cnx->quic->binlog_async != NULL) {
+        (void)binlog_async_push(cnx->quic->binlog_async, f, picoquic_binlog_async_op_write, data1, length1, data2, length2);
+    }
+    else {
+        if (length1 > 0) {
+            (void)fwrite(data1, length1, 1, f);
+        }
+        if (length2 > 0) {
+            (void)fwrite(data2, length2, 1, f);
+        }
+    }
+}
+
+static void binlog_write_record(picoquic_cnx_t* cnx, FILE* f, binlog_record_t* r)
+{
+    if (!r->is_error) {
+        binlog_write(cnx, f, r->data, r->length, NULL, 0);
+    }
+    binlog_record_release(r);
+}
+
+/* Reserve room for a record of up to max_length bytes directly in the
+ * asynchronous ring, if the record would be queued there by binlog_write.
+ * Returns NULL if the record shall be composed in memory instead. */
+static uint8_t* binlog_reserve(picoquic_cnx_t* cnx, FILE* f, size_t max_length)
+{
+    uint8_t* data = NULL;
+
+    if (cnx != NULL && f != NULL && cnx->quic->binlog_async != NULL && cnx->binlog_recorder == NULL &&
+        !((cnx->binlog_block != NULL || cnx->qlog_stream != NULL) && f == cnx->f_binlog)) {
+        data = binlog_async_reserve(cnx->quic->binlog_async, max_length);
+    }
+
+    return data;
+}
+
+/* Start a record, in the room reserved in the ring if possible */
+static void binlog_record_start(picoquic_cnx_t* cnx, FILE* f, binlog_record_t* r, size_t max_length)
+{
+    uint8_t* data = binlog_reserve(cnx, f, max_length);
+
+    binlog_record_init(r);
+    if (data != NULL) {
+        r->data = data;
+        r->size = max_length;
+        r->is_reserved = 1;
+    }
+}
+
+static void binlog_record_finish(picoquic_cnx_t* cnx, FILE* f, binlog_record_t* r)
+{
+    if (r->is_reserved) {
+        /* If the maximum size was wrong, the reserved room is simply not used */
+        if (!r->is_error) {
+            binlog_async_commit(cnx->quic->binlog_async, f, r->length);
+        }
+        binlog_record_release(r);
+    }
+    else {
+        binlog_write_record(cnx, f, r);
+    }
+}
+
+/* Write a chunk made of the message length followed by the message */
+static void binlog_write_chunk(picoquic_cnx_t* cnx, FILE* f, bytestream* msg)
+{
+    uint8_t head[4] = { 0 };
+
+    picoformat_32(head, (uint32_t)bytestream_length(msg));
+    binlog_write(cnx, f, head, sizeof(head), bytestream_data(msg), bytestream_length(msg));
+}
+
+/* Close the log file after its last record */
+static void binlog_file_release(picoquic_quic_t* quic, FILE* f)
+{
+    if (f != NULL) {
+        if (quic->binlog_async != NULL) {
+            (void)binlog_async_push(quic->binlog_async, f, picoquic_binlog_async_op_close, NULL, 0, NULL, 0);
+        }
+        else {
+            (void)picoquic_file_close(f);
+        }
+    }
+}
+
+/* The text log can also be written by the asynchronous writer, see
+ * picoquic_set_textlog_async in logger.c */
+int picoquic_textlog_async_write(picoquic_quic_t* quic, FILE* f, const uint8_t* data, size_t length)
+{
+    return binlog_async_push(quic->binlog_async, f, picoquic_binlog_async_op_write, data, length, NULL, 0);
+}
+
+void picoquic_textlog_async_release(picoquic_quic_t* quic, FILE* f)
+{
+    binlog_file_release(quic, f);
+}
 
 static const uint8_t* picoquic_log_fixed_skip(const uint8_t* bytes, const uint8_t* bytes_max, size_t size)
 {
@@ -58,18 +794,18 @@ static const uint8_t* picoquic_log_length(const uint8_t* bytes, const uint8_t* b
     return (len == 0 || *nsz != n64) ? NULL : bytes + len;
 }
 
-static void picoquic_binlog_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static void picoquic_binlog_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     if (bytes != NULL && bytes_max != NULL) {
         size_t len = bytes_max - bytes;
         uint8_t varlen[8];
         size_t l_varlen = picoquic_varint_encode(varlen, 8, len);
-        fwrite(varlen, 1, l_varlen, f);
-        fwrite(bytes, 1, len, f);
+        binlog_record_append(f, varlen, l_varlen);
+        binlog_record_append(f, bytes, len);
     }
 }
 
-static const uint8_t* picoquic_log_stream_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_stream_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     uint8_t ftype = bytes[0];
@@ -132,7 +868,7 @@ static const uint8_t* picoquic_log_stream_frame(FILE* f, const uint8_t* bytes, c
     return bytes;
 }
 
-static const uint8_t* picoquic_log_ack_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_ack_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     uint64_t ftype = 0;
@@ -167,7 +903,7 @@ static const uint8_t* picoquic_log_ack_frame(FILE* f, const uint8_t* bytes, cons
     return bytes;
 }
 
-static const uint8_t* picoquic_log_reset_stream_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_reset_stream_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t * bytes_begin = bytes;
 
@@ -180,7 +916,7 @@ static const uint8_t* picoquic_log_reset_stream_frame(FILE* f, const uint8_t* by
     return bytes;
 }
 
-static const uint8_t* picoquic_log_stop_sending_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_stop_sending_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -192,7 +928,7 @@ static const uint8_t* picoquic_log_stop_sending_frame(FILE* f, const uint8_t* by
     return bytes;
 }
 
-static const uint8_t* picoquic_log_close_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_close_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     size_t length = 0;
@@ -207,7 +943,7 @@ static const uint8_t* picoquic_log_close_frame(FILE* f, const uint8_t* bytes, co
     return bytes;
 }
 
-static const uint8_t* picoquic_log_app_close_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_app_close_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     size_t length = 0;
@@ -221,7 +957,7 @@ static const uint8_t* picoquic_log_app_close_frame(FILE* f, const uint8_t* bytes
     return bytes;
 }
 
-static const uint8_t* picoquic_log_max_data_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_max_data_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -232,7 +968,7 @@ static const uint8_t* picoquic_log_max_data_frame(FILE* f, const uint8_t* bytes,
     return bytes;
 }
 
-static const uint8_t* picoquic_log_max_stream_data_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_max_stream_data_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -244,7 +980,7 @@ static const uint8_t* picoquic_log_max_stream_data_frame(FILE* f, const uint8_t*
     return bytes;
 }
 
-static const uint8_t* picoquic_log_max_stream_id_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_max_stream_id_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -255,7 +991,7 @@ static const uint8_t* picoquic_log_max_stream_id_frame(FILE* f, const uint8_t* b
     return bytes;
 }
 
-static const uint8_t* picoquic_log_blocked_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_blocked_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -266,7 +1002,7 @@ static const uint8_t* picoquic_log_blocked_frame(FILE* f, const uint8_t* bytes,
     return bytes;
 }
 
-static const uint8_t* picoquic_log_stream_blocked_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_stream_blocked_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -278,7 +1014,7 @@ static const uint8_t* picoquic_log_stream_blocked_frame(FILE* f, const uint8_t*
     return bytes;
 }
 
-static const uint8_t* picoquic_log_streams_blocked_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_streams_blocked_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -289,7 +1025,7 @@ static const uint8_t* picoquic_log_streams_blocked_frame(FILE* f, const uint8_t*
     return bytes;
 }
 
-static const uint8_t* picoquic_log_new_connection_id_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_new_connection_id_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -306,7 +1042,7 @@ static const uint8_t* picoquic_log_new_connection_id_frame(FILE* f, const uint8_
     return bytes;
 }
 
-static const uint8_t* picoquic_log_path_new_connection_id_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_path_new_connection_id_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -324,7 +1060,7 @@ static const uint8_t* picoquic_log_path_new_connection_id_frame(FILE* f, const u
     return bytes;
 }
 
-static const uint8_t* picoquic_log_retire_connection_id_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_retire_connection_id_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -335,7 +1071,7 @@ static const uint8_t* picoquic_log_retire_connection_id_frame(FILE* f, const uin
     return bytes;
 }
 
-static const uint8_t* picoquic_log_path_retire_connection_id_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_path_retire_connection_id_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -347,7 +1083,7 @@ static const uint8_t* picoquic_log_path_retire_connection_id_frame(FILE* f, cons
     return bytes;
 }
 
-static const uint8_t* picoquic_log_new_token_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_new_token_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     size_t length = 0;
@@ -361,7 +1097,7 @@ static const uint8_t* picoquic_log_new_token_frame(FILE* f, const uint8_t* bytes
     return bytes;
 }
 
-static const uint8_t* picoquic_log_path_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_path_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -371,7 +1107,7 @@ static const uint8_t* picoquic_log_path_frame(FILE* f, const uint8_t* bytes, con
     return bytes;
 }
 
-static const uint8_t* picoquic_log_crypto_hs_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_crypto_hs_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     size_t length = 0;
@@ -387,7 +1123,7 @@ static const uint8_t* picoquic_log_crypto_hs_frame(FILE* f, const uint8_t* bytes
 }
 
 
-static const uint8_t* picoquic_log_handshake_done_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_handshake_done_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -397,7 +1133,7 @@ static const uint8_t* picoquic_log_handshake_done_frame(FILE* f, const uint8_t*
     return bytes;
 }
 
-static const uint8_t* picoquic_log_datagram_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_datagram_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     uint8_t ftype = bytes[0];
@@ -417,7 +1153,7 @@ static const uint8_t* picoquic_log_datagram_frame(FILE* f, const uint8_t* bytes,
     return bytes;
 }
 
-static const uint8_t* picoquic_log_time_stamp_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_time_stamp_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -429,7 +1165,7 @@ static const uint8_t* picoquic_log_time_stamp_frame(FILE* f, const uint8_t* byte
     return bytes;
 }
 
-static const uint8_t* picoquic_log_path_abandon_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_path_abandon_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     bytes = picoquic_log_varint_skip(bytes, bytes_max); /* frame type as varint */
@@ -439,7 +1175,7 @@ static const uint8_t* picoquic_log_path_abandon_frame(FILE* f, const uint8_t* by
     return bytes;
 }
 
-static const uint8_t* picoquic_log_path_available_or_backup_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_path_available_or_backup_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     bytes = picoquic_log_varint_skip(bytes, bytes_max); /* frame type as varint */
@@ -450,7 +1186,7 @@ static const uint8_t* picoquic_log_path_available_or_backup_frame(FILE* f, const
 }
 
 
-static const uint8_t* picoquic_log_ack_frequency_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_ack_frequency_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -465,7 +1201,7 @@ static const uint8_t* picoquic_log_ack_frequency_frame(FILE* f, const uint8_t* b
     return bytes;
 }
 
-static const uint8_t* picoquic_log_immediate_ack_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_immediate_ack_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
 
@@ -475,7 +1211,7 @@ static const uint8_t* picoquic_log_immediate_ack_frame(FILE* f, const uint8_t* b
     return bytes;
 }
 
-static const uint8_t* picoquic_log_erroring_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_erroring_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     size_t frame_size = bytes_max - bytes;
     size_t copied = (frame_size > 8) ? 8 : frame_size;
@@ -485,7 +1221,7 @@ static const uint8_t* picoquic_log_erroring_frame(FILE* f, const uint8_t* bytes,
     return NULL;
 }
 
-static const uint8_t* picoquic_log_padding(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_padding(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     picoquic_binlog_frame(f, bytes, bytes + 1);
 
@@ -497,7 +1233,7 @@ static const uint8_t* picoquic_log_padding(FILE* f, const uint8_t* bytes, const
     return bytes;
 }
 
-static const uint8_t* picoquic_log_bdp_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max)
+static const uint8_t* picoquic_log_bdp_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
 {
     const uint8_t* bytes_begin = bytes;
     size_t ip_len = 0;
@@ -514,7 +1250,25 @@ static const uint8_t* picoquic_log_bdp_frame(FILE* f, const uint8_t* bytes, cons
     return bytes;
 }
 
-static const uint8_t* picoquic_log_observed_address_frame(FILE* f, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t ftype)
+static const uint8_t* picoquic_log_fec_repair_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max)
+{
+    const uint8_t* bytes_begin = bytes;
+    size_t symbol_length = 0;
+
+    bytes = picoquic_log_varint_skip(bytes, bytes_max); /* Frame type */
+    bytes = picoquic_log_varint_skip(bytes, bytes_max); /* First packet number */
+    bytes = picoquic_log_varint_skip(bytes, bytes_max); /* Packet mask */
+    bytes = picoquic_log_varint_skip(bytes, bytes_max); /* Length XOR */
+    bytes = picoquic_log_length(bytes, bytes_max, &symbol_length); /* Symbol length */
+
+    /* Do not log the repair symbol itself */
+    picoquic_binlog_frame(f, bytes_begin, bytes);
+
+    bytes = picoquic_log_fixed_skip(bytes, bytes_max, symbol_length);
+    return bytes;
+}
+
+static const uint8_t* picoquic_log_observed_address_frame(binlog_record_t* f, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t ftype)
 {
     const uint8_t* bytes_begin = bytes;
     size_t ip_len = ((ftype & 1) == 0) ? 4 : 16;
@@ -530,7 +1284,7 @@ static const uint8_t* picoquic_log_observed_address_frame(FILE* f, const uint8_t
     return bytes;
 }
 
-void picoquic_binlog_frames(FILE * f, const uint8_t* bytes, size_t length)
+static void binlog_frames_record(binlog_record_t* f, const uint8_t* bytes, size_t length)
 {
     const uint8_t* bytes_max = bytes + length;
 
@@ -649,6 +1403,9 @@ void picoquic_binlog_frames(FILE * f, const uint8_t* bytes, size_t length)
         case picoquic_frame_type_observed_address_v6:
             bytes = picoquic_log_observed_address_frame(f, bytes, bytes_max, ftype);
             break;
+        case picoquic_frame_type_fec_repair:
+            bytes = picoquic_log_fec_repair_frame(f, bytes, bytes_max);
+            break;
         default:
             bytes = picoquic_log_erroring_frame(f, bytes, bytes_max);
             break;
@@ -656,6 +1413,15 @@ void picoquic_binlog_frames(FILE * f, const uint8_t* bytes, size_t length)
     }
 }
 
+void picoquic_binlog_frames(FILE* f, const uint8_t* bytes, size_t length)
+{
+    binlog_record_t r;
+
+    binlog_record_init(&r);
+    binlog_frames_record(&r, bytes, length);
+    binlog_write_record(NULL, f, &r);
+}
+
 static void binlog_compose_event_header(bytestream* msg, const picoquic_connection_id_t* cid, uint64_t current_time,
     uint64_t path_id, picoquic_log_event_type event_type)
 {
@@ -677,100 +1443,138 @@ static uint64_t binlog_get_path_id(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
     return path_id;
 }
 
-void binlog_pdu(FILE* f, const picoquic_connection_id_t* cid, int receiving, uint64_t current_time,
-    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
+/* Maximum size of the common chunk header, see binlog_compose_event_header */
+#define BINLOG_EVENT_HEADER_MAX (BYTEPUT_CID_MAX + 3 * BYTEPUT_VINT_MAX)
+
+static uint8_t* binlog_put_event_header(uint8_t* bytes, const picoquic_connection_id_t* cid, uint64_t current_time,
+    uint64_t path_id, picoquic_log_event_type event_type)
+{
+    bytes = byteput_cid(bytes, cid);
+    bytes = byteput_vint(bytes, current_time);
+    bytes = byteput_vint(bytes, path_id);
+    return byteput_vint(bytes, (uint64_t)event_type);
+}
+
+static void binlog_pdu_write(picoquic_cnx_t* cnx, FILE* f, const picoquic_connection_id_t* cid, int receiving,
+    uint64_t current_time, const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
     uint64_t unique_path_id)
 {
-    bytestream_buf stream_msg;
-    bytestream* msg = bytestream_buf_init(&stream_msg, BYTESTREAM_MAX_BUFFER_SIZE);
+    binlog_record_t r;
+    uint8_t* bytes;
+
+    binlog_record_start(cnx, f, &r, 4 + BINLOG_EVENT_HEADER_MAX + 2 * BYTEPUT_ADDR_MAX + 2 * BYTEPUT_VINT_MAX);
+    bytes = r.data + 4;
 
     /* Common chunk header */
-    binlog_compose_event_header(msg, cid, current_time, 0, picoquic_log_event_pdu_sent + receiving);
+    bytes = binlog_put_event_header(bytes, cid, current_time, 0, picoquic_log_event_pdu_sent + receiving);
 
     /* PDU information */
-    bytewrite_addr(msg, addr_peer);
-    bytewrite_vint(msg, packet_length);
-    bytewrite_addr(msg, addr_local);
-    bytewrite_vint(msg, unique_path_id);
-
-    uint8_t head[4] = { 0 };
-    picoformat_32(head, (uint32_t)bytestream_length(msg));
+    bytes = byteput_addr(bytes, addr_peer);
+    bytes = byteput_vint(bytes, packet_length);
+    bytes = byteput_addr(bytes, addr_local);
+    bytes = byteput_vint(bytes, unique_path_id);
+
+    r.length = bytes - r.data;
+    (void)byteput_int32(r.data, (uint32_t)(r.length - 4));
+    binlog_record_finish(cnx, f, &r);
+}
 
-    (void)fwrite(head, sizeof(head), 1, f);
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+void binlog_pdu(FILE* f, const picoquic_connection_id_t* cid, int receiving, uint64_t current_time,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
+    uint64_t unique_path_id)
+{
+    binlog_pdu_write(NULL, f, cid, receiving, current_time, addr_peer, addr_local, packet_length, unique_path_id);
 }
 
 static void binlog_pdu_ex(picoquic_cnx_t* cnx, int receiving, uint64_t current_time,
     const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
     uint64_t unique_path_id)
 {
-    if (cnx != NULL && cnx->f_binlog != NULL && picoquic_cnx_is_still_logging(cnx)) {
-        binlog_pdu(cnx->f_binlog, &cnx->initial_cnxid, receiving, current_time, addr_peer, addr_local, packet_length,
-            unique_path_id);
+    if (cnx != NULL && PICOQUIC_CNX_IS_BINLOGGING(cnx) && picoquic_cnx_is_still_logging(cnx)) {
+        binlog_pdu_write(cnx, cnx->f_binlog, &cnx->initial_cnxid, receiving, current_time,
+            addr_peer, addr_local, packet_length, unique_path_id);
     }
 }
 
-void binlog_packet(FILE* f, const picoquic_connection_id_t* cid, uint64_t path_id, int receiving, uint64_t current_time,
-    const picoquic_packet_header* ph, const uint8_t* bytes, size_t bytes_max)
-{
-    long fpos0 = ftell(f);
+/* The frames are logged with at most twice their size, e.g., when a padding
+ * byte and a ping byte alternate, plus the length of a stream frame without
+ * a length field. */
+#define BINLOG_PACKET_HEADER_MAX (4 + BINLOG_EVENT_HEADER_MAX + 1 + 4 * BYTEPUT_VINT_MAX + 2 * BYTEPUT_CID_MAX + 4 + BYTEPUT_VINT_MAX)
 
-    uint8_t head[4] = { 0 };
-    (void)fwrite(head, 4, 1, f);
+static void binlog_packet_write(picoquic_cnx_t* cnx, FILE* f, const picoquic_connection_id_t* cid, uint64_t path_id,
+    int receiving, uint64_t current_time, const picoquic_packet_header* ph, const uint8_t* bytes, size_t bytes_max)
+{
+    binlog_record_t r;
+    uint8_t* next;
+    size_t max_length = BINLOG_PACKET_HEADER_MAX;
 
-    bytestream_buf stream_msg;
-    bytestream* msg = bytestream_buf_init(&stream_msg, BYTESTREAM_MAX_BUFFER_SIZE);
+    if (ph->ptype == picoquic_packet_initial) {
+        max_length += ph->token_length;
+    }
+    if (ph->ptype == picoquic_packet_version_negotiation || ph->ptype == picoquic_packet_retry) {
+        max_length += BYTEPUT_VINT_MAX + bytes_max - ph->offset;
+    }
+    else if (ph->ptype != picoquic_packet_error) {
+        max_length += 2 * ph->payload_length + 32;
+    }
+    binlog_record_start(cnx, f, &r, max_length);
 
-    /* Common chunk header */
-    binlog_compose_event_header(msg, cid, current_time, path_id, picoquic_log_event_packet_sent + receiving);
+    if ((next = binlog_record_room(&r, BINLOG_PACKET_HEADER_MAX + ph->token_length)) != NULL) {
+        next += 4;
 
-    /* packet information */
-    bytewrite_vint(msg, bytes_max);
+        /* Common chunk header */
+        next = binlog_put_event_header(next, cid, current_time, path_id, picoquic_log_event_packet_sent + receiving);
 
-    /* packet header */
-    bytewrite_int8(msg, (uint8_t)(64*ph->quic_bit_is_zero + 2 * ph->spin + ph->key_phase));
-    bytewrite_vint(msg, ph->payload_length);
-    bytewrite_vint(msg, ph->ptype);
-    bytewrite_vint(msg, ph->pn64);
+        /* packet information */
+        next = byteput_vint(next, bytes_max);
 
-    bytewrite_cid(msg, &ph->dest_cnx_id);
-    bytewrite_cid(msg, &ph->srce_cnx_id);
+        /* packet header */
+        next = byteput_int8(next, (uint8_t)(64 * ph->quic_bit_is_zero + 2 * ph->spin + ph->key_phase));
+        next = byteput_vint(next, ph->payload_length);
+        next = byteput_vint(next, ph->ptype);
+        next = byteput_vint(next, ph->pn64);
 
-    if (ph->ptype != picoquic_packet_1rtt_protected &&
-        ph->ptype != picoquic_packet_version_negotiation) {
-        bytewrite_int32(msg, ph->vn);
-    }
+        next = byteput_cid(next, &ph->dest_cnx_id);
+        next = byteput_cid(next, &ph->srce_cnx_id);
 
-    if (ph->ptype == picoquic_packet_initial) {
-        bytewrite_vint(msg, ph->token_length);
-        bytewrite_buffer(msg, ph->token_bytes, ph->token_length);
-    }
+        if (ph->ptype != picoquic_packet_1rtt_protected &&
+            ph->ptype != picoquic_packet_version_negotiation) {
+            next = byteput_int32(next, ph->vn);
+        }
 
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+        if (ph->ptype == picoquic_packet_initial) {
+            next = byteput_vint(next, ph->token_length);
+            next = byteput_buffer(next, ph->token_bytes, ph->token_length);
+        }
+        r.length = next - r.data;
 
-    /* frame information */
-    if (ph->ptype == picoquic_packet_version_negotiation || ph->ptype == picoquic_packet_retry) {
-        picoquic_binlog_frame(f, bytes + ph->offset, bytes + bytes_max);
-    }
-    else if (ph->ptype != picoquic_packet_error) {
-        picoquic_binlog_frames(f, bytes + ph->offset, ph->payload_length);
+        /* frame information */
+        if (ph->ptype == picoquic_packet_version_negotiation || ph->ptype == picoquic_packet_retry) {
+            picoquic_binlog_frame(&r, bytes + ph->offset, bytes + bytes_max);
+        }
+        else if (ph->ptype != picoquic_packet_error) {
+            binlog_frames_record(&r, bytes + ph->offset, ph->payload_length);
+        }
     }
 
-    /* re-write chunk size field */
-    long fpos1 = ftell(f);
-
-    picoformat_32(head, (uint32_t)(fpos1 - fpos0 - 4));
+    /* write the chunk size field, now that the record is complete */
+    if (!r.is_error) {
+        picoformat_32(r.data, (uint32_t)(r.length - 4));
+    }
+    binlog_record_finish(cnx, f, &r);
+}
 
-    (void)fseek(f, fpos0, SEEK_SET);
-    (void)fwrite(head, 4, 1, f);
-    (void)fseek(f, 0, SEEK_END);
+void binlog_packet(FILE* f, const picoquic_connection_id_t* cid, uint64_t path_id, int receiving, uint64_t current_time,
+    const picoquic_packet_header* ph, const uint8_t* bytes, size_t bytes_max)
+{
+    binlog_packet_write(NULL, f, cid, path_id, receiving, current_time, ph, bytes, bytes_max);
 }
 
 static void binlog_packet_ex(picoquic_cnx_t* cnx, picoquic_path_t * path_x, int receiving, uint64_t current_time,
     picoquic_packet_header* ph, const uint8_t* bytes, size_t bytes_max)
 {
-    if (cnx != NULL && cnx->f_binlog != NULL && picoquic_cnx_is_still_logging(cnx)) {
-        binlog_packet(cnx->f_binlog, &cnx->initial_cnxid, binlog_get_path_id(cnx, path_x),
+    if (cnx != NULL && PICOQUIC_CNX_IS_BINLOGGING(cnx) && picoquic_cnx_is_still_logging(cnx)) {
+        binlog_packet_write(cnx, cnx->f_binlog, &cnx->initial_cnxid, binlog_get_path_id(cnx, path_x),
             receiving, current_time, ph, bytes, bytes_max);
     }
 }
@@ -804,7 +1608,7 @@ void binlog_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
 
     /* write the frame length at the reserved spot, and save to log file*/
     picoformat_32(msg->data, (uint32_t)(msg->ptr - 4));
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(msg), bytestream_length(msg), NULL, 0);
 }
 
 void binlog_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, 
@@ -824,7 +1628,7 @@ void binlog_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
 
     /* write the frame length at the reserved spot, and save to log file*/
     picoformat_32(msg->data, (uint32_t)(msg->ptr - 4));
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(msg), bytestream_length(msg), NULL, 0);
 }
 
 
@@ -874,7 +1678,7 @@ void binlog_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
         }
     }
 
-    binlog_packet(f, cnxid, binlog_get_path_id(cnx, path_x),  0, current_time, &ph, bytes, length);
+    binlog_packet_write(cnx, f, cnxid, binlog_get_path_id(cnx, path_x),  0, current_time, &ph, bytes, length);
 }
 
 void binlog_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
@@ -904,7 +1708,7 @@ void binlog_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
 
     /* write the frame length at the reserved spot, and save to log file*/
     picoformat_32(msg->data, (uint32_t)(msg->ptr - 4));
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(msg), bytestream_length(msg), NULL, 0);
 }
 
 
@@ -942,8 +1746,10 @@ void binlog_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
     bytestream* head = bytestream_buf_init(&stream_head, 4);
     bytewrite_int32(head, (uint32_t)bytestream_length(msg));
 
-    (void)fwrite(bytestream_data(head), bytestream_length(head), 1, f);
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(head), bytestream_length(head),
+        bytestream_data(msg), bytestream_length(msg));
+
+    binlog_policy_check_names(cnx, sni, sni_len, alpn, alpn_len);
 }
 
 void binlog_transport_extension(picoquic_cnx_t* cnx, int is_local,
@@ -967,11 +1773,11 @@ void binlog_transport_extension(picoquic_cnx_t* cnx, int is_local,
     bytestream* head = bytestream_buf_init(&stream_head, 4);
     bytewrite_int32(head, (uint32_t)bytestream_length(msg));
 
-    (void)fwrite(bytestream_data(head), bytestream_length(head), 1, f);
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(head), bytestream_length(head),
+        bytestream_data(msg), bytestream_length(msg));
 }
 
-void binlog_picotls_ticket(FILE* f, picoquic_connection_id_t cnx_id,
+static void binlog_picotls_ticket_write(picoquic_cnx_t* cnx, FILE* f, picoquic_connection_id_t cnx_id,
     uint8_t* ticket, uint16_t ticket_length)
 {
     bytestream_buf stream_msg;
@@ -986,36 +1792,231 @@ void binlog_picotls_ticket(FILE* f, picoquic_connection_id_t cnx_id,
     bytestream * head = bytestream_buf_init(&stream_head, 8);
     bytewrite_int32(head, (uint32_t)bytestream_length(msg));
 
-    (void)fwrite(bytestream_data(head), bytestream_length(head), 1, f);
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(head), bytestream_length(head),
+        bytestream_data(msg), bytestream_length(msg));
+}
+
+void binlog_picotls_ticket(FILE* f, picoquic_connection_id_t cnx_id,
+    uint8_t* ticket, uint16_t ticket_length)
+{
+    binlog_picotls_ticket_write(NULL, f, cnx_id, ticket, ticket_length);
 }
 
 static void binlog_picotls_ticket_ex(picoquic_cnx_t* cnx,
     uint8_t* ticket, uint16_t ticket_length)
 {
-    if (cnx != NULL && cnx->f_binlog != NULL && picoquic_cnx_is_still_logging(cnx)) {
-        binlog_picotls_ticket(cnx->f_binlog, cnx->initial_cnxid, ticket, ticket_length);
+    if (cnx != NULL && PICOQUIC_CNX_IS_BINLOGGING(cnx) && picoquic_cnx_is_still_logging(cnx)) {
+        binlog_picotls_ticket_write(cnx, cnx->f_binlog, cnx->initial_cnxid, ticket, ticket_length);
     }
 }
 
 FILE* create_binlog(char const* binlog_file, uint64_t creation_time, unsigned int multipath_enabled);
+static FILE* binlog_create_file(char const* binlog_file, uint64_t creation_time, unsigned int is_multipath_supported,
+    uint16_t version);
 
-void binlog_new_connection(picoquic_cnx_t * cnx)
+/*
+ * Logging policies.
+ *
+ * By default, all connections are logged. The policy set by picoquic_set_log_policy
+ * can restrict that to one connection in N, or to connections matching an SNI,
+ * an ALPN or an initial CID prefix. The CID prefix and the sampling are checked
+ * when the connection starts. The SNI and ALPN are only known to the server after
+ * the client hello is processed, so the records are kept in memory until then.
+ *
+ * In flight recorder mode, records are kept in memory instead of being written
+ * to disk. Records written during the handshake are always kept; the following
+ * ones are kept for the configured duration, and within the configured memory
+ * budget. The recorder content is written to a log file when a trigger fires:
+ * close with an error, a burst of spurious retransmissions, an RTT spike, or an
+ * explicit call to picoquic_trigger_flight_recorder. After that, the connection
+ * logs directly to the file. If no trigger fires, nothing is written.
+ */
+#define PICOQUIC_LOG_RECORDER_MAX_BYTES_DEFAULT 0x40000
+#define PICOQUIC_LOG_RECORDER_INITIAL_SIZE 0x1000
+#define PICOQUIC_LOG_SPURIOUS_THRESHOLD_DEFAULT 8
+#define PICOQUIC_LOG_RTT_SPIKE_FACTOR_DEFAULT 4
+#define PICOQUIC_LOG_RTT_SPIKE_MIN_DELTA 10000
+
+typedef struct st_picoquic_log_policy_ctx_t {
+    picoquic_log_policy_t policy; /* sni and alpn point to the copies below */
+    char* sni;
+    char* alpn;
+    uint64_t nb_connections_sampled;
+    picoquic_log_policy_stats_t stats;
+} picoquic_log_policy_ctx_t;
+
+typedef struct st_picoquic_binlog_recorder_t {
+    uint8_t* buffer;
+    size_t size;
+    size_t length;
+    size_t pinned_length; /* chunks kept until the end of the connection */
+    size_t first_timed; /* oldest record kept in the timed part, each prefixed by its time */
+    uint64_t window_start;
+    uint64_t window_nb_spurious;
+    unsigned int is_flight_recorder : 1;
+    unsigned int is_filter_pending : 1;
+} picoquic_binlog_recorder_t;
+
+typedef enum {
+    binlog_policy_match = 0,
+    binlog_policy_mismatch,
+    binlog_policy_pending
+} binlog_policy_match_enum;
+
+static binlog_policy_match_enum binlog_policy_match_name(char const* filter, const uint8_t* name, size_t name_len)
 {
-    char const* bin_dir = (cnx->quic->binlog_dir == NULL) ? cnx->quic->qlog_dir : cnx->quic->binlog_dir;
+    binlog_policy_match_enum match = binlog_policy_match;
 
-    if (bin_dir == NULL) {
-        return;
+    if (filter != NULL) {
+        if (name == NULL || name_len == 0) {
+            match = binlog_policy_pending;
+        }
+        else if (strlen(filter) != name_len || memcmp(filter, name, name_len) != 0) {
+            match = binlog_policy_mismatch;
+        }
     }
+    return match;
+}
 
-    if (cnx->quic->current_number_of_open_logs >= cnx->quic->max_simultaneous_logs) {
-        return;
+static binlog_policy_match_enum binlog_policy_match_names(picoquic_log_policy_ctx_t* log_policy,
+    const uint8_t* sni, size_t sni_len, const uint8_t* alpn, size_t alpn_len)
+{
+    binlog_policy_match_enum sni_match = binlog_policy_match_name(log_policy->sni, sni, sni_len);
+    binlog_policy_match_enum alpn_match = binlog_policy_match_name(log_policy->alpn, alpn, alpn_len);
+
+    return (sni_match == binlog_policy_mismatch || alpn_match == binlog_policy_mismatch) ? binlog_policy_mismatch :
+        ((sni_match == binlog_policy_pending || alpn_match == binlog_policy_pending) ? binlog_policy_pending : binlog_policy_match);
+}
+
+static void binlog_recorder_free(picoquic_cnx_t* cnx)
+{
+    if (cnx->binlog_recorder != NULL) {
+        free(cnx->binlog_recorder->buffer);
+        free(cnx->binlog_recorder);
+        cnx->binlog_recorder = NULL;
     }
+}
+
+static void binlog_recorder_discard(picoquic_cnx_t* cnx)
+{
+    if (cnx->binlog_recorder != NULL) {
+        cnx->quic->log_policy->stats.nb_recorders_discarded++;
+        binlog_recorder_free(cnx);
+    }
+}
 
+static int binlog_recorder_create(picoquic_cnx_t* cnx, int is_flight_recorder, int is_filter_pending)
+{
     int ret = 0;
+    picoquic_binlog_recorder_t* r = (picoquic_binlog_recorder_t*)malloc(sizeof(picoquic_binlog_recorder_t));
+
+    if (r == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(r, 0, sizeof(picoquic_binlog_recorder_t));
+        r->is_flight_recorder = is_flight_recorder;
+        r->is_filter_pending = is_filter_pending;
+        r->window_start = picoquic_get_quic_time(cnx->quic);
+        r->window_nb_spurious = cnx->nb_spurious;
+        cnx->binlog_recorder = r;
+    }
+    return ret;
+}
+
+/* Forget the timed records that are too old, or that do not leave room for the next one */
+static void binlog_recorder_trim(picoquic_binlog_recorder_t* r, uint64_t current_time, uint64_t duration,
+    size_t needed, size_t max_bytes)
+{
+    while (r->first_timed + 12 <= r->length) {
+        uint64_t record_time;
+        size_t record_length = 12 + (size_t)PICOPARSE_32(r->buffer + r->first_timed + 8);
+
+        memcpy(&record_time, r->buffer + r->first_timed, 8);
+        if (record_time + duration < current_time ||
+            r->pinned_length + (r->length - r->first_timed) + needed > max_bytes) {
+            r->first_timed += record_length;
+        }
+        else {
+            break;
+        }
+    }
+    if (r->first_timed >= r->length) {
+        r->length = r->pinned_length;
+        r->first_timed = r->pinned_length;
+    }
+    else if (r->first_timed > r->pinned_length &&
+        (r->first_timed - r->pinned_length > r->length / 2 || r->length + needed > max_bytes)) {
+        memmove(r->buffer + r->pinned_length, r->buffer + r->first_timed, r->length - r->first_timed);
+        r->length -= r->first_timed - r->pinned_length;
+        r->first_timed = r->pinned_length;
+    }
+}
+
+static void binlog_recorder_append(picoquic_cnx_t* cnx, const uint8_t* data1, size_t length1,
+    const uint8_t* data2, size_t length2)
+{
+    picoquic_binlog_recorder_t* r = cnx->binlog_recorder;
+    picoquic_log_policy_ctx_t* log_policy = cnx->quic->log_policy;
+    size_t max_bytes = (log_policy->policy.flight_recorder_max_bytes == 0) ?
+        PICOQUIC_LOG_RECORDER_MAX_BYTES_DEFAULT : log_policy->policy.flight_recorder_max_bytes;
+    int is_pinned = (r->pinned_length == r->length) &&
+        (r->is_filter_pending || cnx->cnx_state < picoquic_state_server_false_start);
+    uint64_t current_time = picoquic_get_quic_time(cnx->quic);
+    size_t needed = length1 + length2 + ((is_pinned) ? 0 : 8);
+
+    if (!is_pinned && r->is_flight_recorder) {
+        binlog_recorder_trim(r, current_time, log_policy->policy.flight_recorder_duration, needed, max_bytes);
+    }
+
+    if (r->length + needed > max_bytes) {
+        log_policy->stats.nb_records_dropped++;
+    }
+    else {
+        if (r->length + needed > r->size) {
+            size_t new_size = (r->size == 0) ? PICOQUIC_LOG_RECORDER_INITIAL_SIZE : 2 * r->size;
+            uint8_t* new_buffer;
+
+            while (new_size < r->length + needed) {
+                new_size *= 2;
+            }
+            if (new_size > max_bytes) {
+                new_size = max_bytes;
+            }
+            if ((new_buffer = (uint8_t*)realloc(r->buffer, new_size)) == NULL) {
+                log_policy->stats.nb_records_dropped++;
+                return;
+            }
+            r->buffer = new_buffer;
+            r->size = new_size;
+        }
+        if (!is_pinned) {
+            memcpy(r->buffer + r->length, &current_time, 8);
+            r->length += 8;
+        }
+        memcpy(r->buffer + r->length, data1, length1);
+        r->length += length1;
+        if (length2 > 0) {
+            memcpy(r->buffer + r->length, data2, length2);
+            r->length += length2;
+        }
+        if (is_pinned) {
+            r->pinned_length = r->length;
+            r->first_timed = r->length;
+        }
+    }
+}
+
+/* Create the log file of the connection and write the file header */
+static int binlog_open_file(picoquic_cnx_t* cnx)
+{
+    char const* bin_dir = (cnx->quic->binlog_dir == NULL) ? cnx->quic->qlog_dir : cnx->quic->binlog_dir;
+    int ret = 0;
+
+    if (cnx->quic->current_number_of_open_logs >= cnx->quic->max_simultaneous_logs) {
+        return -1;
+    }
 
-    cnx->f_binlog = picoquic_file_close(cnx->f_binlog);
-    
     char cid_name[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
     if (picoquic_print_connection_id_hexa(cid_name, sizeof(cid_name), &cnx->initial_cnxid) != 0) {
         ret = -1;
@@ -1044,9 +2045,14 @@ void binlog_new_connection(picoquic_cnx_t * cnx)
     }
 
     if (ret == 0) {
-        cnx->f_binlog = create_binlog(log_filename, picoquic_get_quic_time(cnx->quic),
-           cnx->local_parameters.is_multipath_enabled);
+        /* If the block cannot be allocated, log in the uncompressed format */
+        int is_compressed = cnx->quic->binlog_block_size > 0 && binlog_block_create(cnx) == 0;
+
+        cnx->f_binlog = binlog_create_file(log_filename, picoquic_get_quic_time(cnx->quic),
+           cnx->local_parameters.is_multipath_enabled,
+            (is_compressed) ? PICOQUIC_BINLOG_VERSION_BLOCKS : PICOQUIC_BINLOG_VERSION);
         if (cnx->f_binlog == NULL) {
+            binlog_block_free(cnx);
             cnx->binlog_file_name = picoquic_string_free(cnx->binlog_file_name);
             ret = -1;
         }
@@ -1055,6 +2061,226 @@ void binlog_new_connection(picoquic_cnx_t * cnx)
         }
     }
 
+    return ret;
+}
+
+/* Write the content of the recorder to the log file, then log directly to the file */
+static void binlog_recorder_flush(picoquic_cnx_t* cnx)
+{
+    picoquic_binlog_recorder_t* r = cnx->binlog_recorder;
+
+    if (r == NULL || r->is_filter_pending) {
+        return;
+    }
+    cnx->binlog_recorder = NULL;
+    if (binlog_open_file(cnx) != 0) {
+        cnx->binlog_recorder = r;
+        binlog_recorder_discard(cnx);
+    }
+    else {
+        size_t offset = 0;
+
+        while (offset + 4 <= r->pinned_length) {
+            size_t chunk_length = 4 + (size_t)PICOPARSE_32(r->buffer + offset);
+            binlog_write(cnx, cnx->f_binlog, r->buffer + offset, chunk_length, NULL, 0);
+            offset += chunk_length;
+        }
+        /* Timed records start with the record time, which is not part of the chunk */
+        offset = r->first_timed;
+        while (offset + 12 <= r->length) {
+            size_t chunk_length = 4 + (size_t)PICOPARSE_32(r->buffer + offset + 8);
+            binlog_write(cnx, cnx->f_binlog, r->buffer + offset + 8, chunk_length, NULL, 0);
+            offset += 8 + chunk_length;
+        }
+        cnx->binlog_recorder = r;
+        binlog_recorder_free(cnx);
+        cnx->quic->log_policy->stats.nb_recorders_flushed++;
+    }
+}
+
+/* Check the triggers of the flight recorder, on each congestion control update */
+static void binlog_recorder_check_triggers(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_binlog_recorder_t* r = cnx->binlog_recorder;
+    picoquic_log_policy_t* policy = &cnx->quic->log_policy->policy;
+    int is_triggered = 0;
+
+    if (r == NULL || !r->is_flight_recorder || r->is_filter_pending) {
+        return;
+    }
+
+    if ((policy->triggers & picoquic_log_trigger_spurious_storm) != 0) {
+        uint64_t threshold = (policy->spurious_storm_threshold == 0) ?
+            PICOQUIC_LOG_SPURIOUS_THRESHOLD_DEFAULT : policy->spurious_storm_threshold;
+
+        if (cnx->nb_spurious - r->window_nb_spurious >= threshold) {
+            is_triggered = 1;
+        }
+        else if (current_time > r->window_start + policy->flight_recorder_duration) {
+            r->window_start = current_time;
+            r->window_nb_spurious = cnx->nb_spurious;
+        }
+    }
+
+    if ((policy->triggers & picoquic_log_trigger_rtt_spike) != 0 && cnx->path[0] != NULL) {
+        picoquic_path_t* path_x = cnx->path[0];
+        uint64_t factor = (policy->rtt_spike_factor == 0) ? PICOQUIC_LOG_RTT_SPIKE_FACTOR_DEFAULT : policy->rtt_spike_factor;
+
+        if (path_x->rtt_min > 0 && path_x->rtt_sample > factor * path_x->rtt_min &&
+            path_x->rtt_sample > path_x->rtt_min + PICOQUIC_LOG_RTT_SPIKE_MIN_DELTA) {
+            is_triggered = 1;
+        }
+    }
+
+    if (is_triggered) {
+        binlog_recorder_flush(cnx);
+    }
+}
+
+/* Decide whether the connection is logged, and whether the records are first kept in memory */
+static int binlog_policy_check(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+    picoquic_log_policy_ctx_t* log_policy = cnx->quic->log_policy;
+
+    if (log_policy == NULL) {
+        return 0;
+    }
+
+    if (!cnx->is_log_policy_checked) {
+        /* Only count the connection once, even if the client restarts after a retry */
+        cnx->is_log_policy_checked = 1;
+        if (log_policy->policy.sample_one_in_n > 1 &&
+            (log_policy->nb_connections_sampled++ % log_policy->policy.sample_one_in_n) != 0) {
+            log_policy->stats.nb_sampled_out++;
+            cnx->is_log_policy_rejected = 1;
+        }
+        else if (log_policy->policy.cid_prefix.id_len > 0 &&
+            (cnx->initial_cnxid.id_len < log_policy->policy.cid_prefix.id_len ||
+                memcmp(cnx->initial_cnxid.id, log_policy->policy.cid_prefix.id, log_policy->policy.cid_prefix.id_len) != 0)) {
+            log_policy->stats.nb_filtered_out++;
+            cnx->is_log_policy_rejected = 1;
+        }
+    }
+
+    if (cnx->is_log_policy_rejected) {
+        ret = -1;
+    }
+    else {
+        binlog_policy_match_enum match = binlog_policy_match_names(log_policy,
+            (const uint8_t*)cnx->sni, (cnx->sni == NULL) ? 0 : strlen(cnx->sni),
+            (const uint8_t*)cnx->alpn, (cnx->alpn == NULL) ? 0 : strlen(cnx->alpn));
+
+        if (match == binlog_policy_mismatch) {
+            log_policy->stats.nb_filtered_out++;
+            cnx->is_log_policy_rejected = 1;
+            ret = -1;
+        }
+        else if (match == binlog_policy_pending || log_policy->policy.flight_recorder_duration > 0) {
+            ret = binlog_recorder_create(cnx, log_policy->policy.flight_recorder_duration > 0,
+                match == binlog_policy_pending);
+        }
+    }
+
+    return ret;
+}
+
+/* Apply the SNI and ALPN filters once the values are known */
+static void binlog_policy_check_names(picoquic_cnx_t* cnx, uint8_t const* sni, size_t sni_len,
+    uint8_t const* alpn, size_t alpn_len)
+{
+    picoquic_binlog_recorder_t* r = cnx->binlog_recorder;
+
+    if (r != NULL && r->is_filter_pending) {
+        binlog_policy_match_enum match;
+
+        if (sni_len == 0 && cnx->sni != NULL) {
+            sni = (const uint8_t*)cnx->sni;
+            sni_len = strlen(cnx->sni);
+        }
+        if (alpn_len == 0 && cnx->alpn != NULL) {
+            alpn = (const uint8_t*)cnx->alpn;
+            alpn_len = strlen(cnx->alpn);
+        }
+        match = binlog_policy_match_names(cnx->quic->log_policy, sni, sni_len, alpn, alpn_len);
+        if (match == binlog_policy_mismatch) {
+            cnx->quic->log_policy->stats.nb_filtered_out++;
+            cnx->is_log_policy_rejected = 1;
+            binlog_recorder_free(cnx);
+        }
+        else if (match == binlog_policy_match) {
+            r->is_filter_pending = 0;
+            if (!r->is_flight_recorder) {
+                binlog_recorder_flush(cnx);
+            }
+        }
+    }
+}
+
+/* Open the streaming qlog of the connection. If there is no binary log
+ * folder, the stream replaces the temporary log file and takes its place
+ * in the count of open logs. */
+static int binlog_qlog_stream_open(picoquic_cnx_t* cnx)
+{
+    int ret = -1;
+
+    if (cnx->quic->qlog_dir != NULL && cnx->quic->qlog_stream_open_fn != NULL &&
+        (cnx->quic->binlog_dir != NULL || cnx->quic->current_number_of_open_logs < cnx->quic->max_simultaneous_logs)) {
+        if ((cnx->qlog_stream = cnx->quic->qlog_stream_open_fn(cnx)) != NULL) {
+            if (cnx->quic->binlog_dir == NULL) {
+                cnx->quic->current_number_of_open_logs++;
+            }
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
+static void binlog_qlog_stream_close(picoquic_cnx_t* cnx)
+{
+    if (cnx->qlog_stream != NULL) {
+        binlog_qlog_stream_release(cnx);
+        if (cnx->quic->binlog_dir == NULL && cnx->quic->current_number_of_open_logs > 0) {
+            cnx->quic->current_number_of_open_logs--;
+        }
+    }
+}
+
+void binlog_new_connection(picoquic_cnx_t * cnx)
+{
+    char const* bin_dir = (cnx->quic->binlog_dir == NULL) ? cnx->quic->qlog_dir : cnx->quic->binlog_dir;
+
+    if (bin_dir == NULL) {
+        return;
+    }
+
+    int ret = 0;
+
+    if (cnx->f_binlog != NULL) {
+        binlog_block_free(cnx);
+        binlog_file_release(cnx->quic, cnx->f_binlog);
+        cnx->f_binlog = NULL;
+        if (cnx->quic->current_number_of_open_logs > 0) {
+            cnx->quic->current_number_of_open_logs--;
+        }
+    }
+    binlog_qlog_stream_close(cnx);
+    binlog_recorder_free(cnx);
+
+    ret = binlog_policy_check(cnx);
+
+    if (ret == 0 && cnx->binlog_recorder == NULL) {
+        /* The log file is only needed for the qlog if it cannot be streamed */
+        int is_streaming = (binlog_qlog_stream_open(cnx) == 0);
+
+        if (!is_streaming || cnx->quic->binlog_dir != NULL) {
+            if (binlog_open_file(cnx) != 0 && !is_streaming) {
+                ret = -1;
+            }
+        }
+    }
+
     if (ret == 0) {
         bytestream_buf stream_msg;
         bytestream * msg = bytestream_buf_init(&stream_msg, BYTESTREAM_MAX_BUFFER_SIZE);
@@ -1073,15 +2299,26 @@ void binlog_new_connection(picoquic_cnx_t * cnx)
         bytestream * head = bytestream_buf_init(&stream_head, 8);
         bytewrite_int32(head, (uint32_t)bytestream_length(msg));
 
-        (void)fwrite(bytestream_data(head), bytestream_length(head), 1, cnx->f_binlog);
-        (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, cnx->f_binlog);
+        binlog_write(cnx, cnx->f_binlog, bytestream_data(head), bytestream_length(head),
+            bytestream_data(msg), bytestream_length(msg));
     }
 }
 
 void binlog_close_connection(picoquic_cnx_t * cnx)
 {
+    if (cnx->binlog_recorder != NULL) {
+        if ((cnx->quic->log_policy->policy.triggers & picoquic_log_trigger_close_error) != 0 &&
+            (cnx->local_error != 0 || cnx->remote_error != 0 ||
+                cnx->application_error != 0 || cnx->remote_application_error != 0)) {
+            binlog_recorder_flush(cnx);
+        }
+        /* If nothing triggered, the records are not needed */
+        binlog_recorder_discard(cnx);
+    }
+
     FILE * f = cnx->f_binlog;
-    if (f == NULL) {
+    int is_streaming = (cnx->qlog_stream != NULL);
+    if (f == NULL && !is_streaming) {
         return;
     }
 
@@ -1094,14 +2331,26 @@ void binlog_close_connection(picoquic_cnx_t * cnx)
     bytestream * head = bytestream_buf_init(&stream_head, 8);
     bytewrite_int32(head, (uint32_t)bytestream_length(msg));
 
-    (void)fwrite(bytestream_data(head), bytestream_length(head), 1, f);
-    (void)fwrite(bytestream_data(msg), bytestream_length(msg), 1, f);
+    binlog_write(cnx, f, bytestream_data(head), bytestream_length(head),
+        bytestream_data(msg), bytestream_length(msg));
+    binlog_block_free(cnx);
+    binlog_qlog_stream_close(cnx);
 
-    fflush(f);
+    if (f == NULL) {
+        return;
+    }
 
-    cnx->f_binlog = picoquic_file_close(cnx->f_binlog);
+    if (cnx->quic->binlog_async == NULL) {
+        fflush(f);
+    }
+    binlog_file_release(cnx->quic, f);
+    cnx->f_binlog = NULL;
 
-    if (cnx->quic->qlog_dir != NULL && cnx->quic->autoqlog_fn != NULL) {
+    if (!is_streaming && cnx->quic->qlog_dir != NULL && cnx->quic->autoqlog_fn != NULL) {
+        if (cnx->quic->binlog_async != NULL) {
+            /* The conversion reads the file, which must be complete */
+            binlog_async_drain(cnx->quic->binlog_async);
+        }
         (void)cnx->quic->autoqlog_fn(cnx);
     }
     cnx->binlog_file_name = picoquic_string_free(cnx->binlog_file_name);
@@ -1111,6 +2360,12 @@ void binlog_close_connection(picoquic_cnx_t * cnx)
 }
 
 FILE* create_binlog(char const* binlog_file, uint64_t creation_time, unsigned int is_multipath_supported)
+{
+    return binlog_create_file(binlog_file, creation_time, is_multipath_supported, PICOQUIC_BINLOG_VERSION);
+}
+
+static FILE* binlog_create_file(char const* binlog_file, uint64_t creation_time, unsigned int is_multipath_supported,
+    uint16_t version)
 {
     FILE* f_binlog = picoquic_file_open(binlog_file, "wb");
     if (f_binlog == NULL) {
@@ -1122,7 +2377,7 @@ FILE* create_binlog(char const* binlog_file, uint64_t creation_time, unsigned in
         bytestream* ps = bytestream_buf_init(&stream, 16);
         bytewrite_int32(ps, FOURCC('q', 'l', 'o', 'g'));
         bytewrite_int16(ps, (is_multipath_supported) ? 0x01 : 0); /* flags */
-        bytewrite_int16(ps, 0x01); /* version */
+        bytewrite_int16(ps, version);
         bytewrite_int64(ps, creation_time);
 
         if (fwrite(bytestream_data(ps), bytestream_length(ps), 1, f_binlog) <= 0) {
@@ -1142,7 +2397,9 @@ FILE* create_binlog(char const* binlog_file, uint64_t creation_time, unsigned in
 
 void binlog_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
 {
-    if (cnx->f_binlog == NULL) {
+    binlog_recorder_check_triggers(cnx, current_time);
+
+    if (!PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         return;
     }
 
@@ -1229,8 +2486,8 @@ void binlog_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
 
         bytewrite_int32(ps_head, (uint32_t)bytestream_length(ps_msg));
 
-        (void)fwrite(bytestream_data(ps_head), bytestream_length(ps_head), 1, cnx->f_binlog);
-        (void)fwrite(bytestream_data(ps_msg), bytestream_length(ps_msg), 1, cnx->f_binlog);
+        binlog_write(cnx, cnx->f_binlog, bytestream_data(ps_head), bytestream_length(ps_head),
+            bytestream_data(ps_msg), bytestream_length(ps_msg));
     }
 }
 
@@ -1240,7 +2497,7 @@ void binlog_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
 
 void picoquic_binlog_message_v(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
 {
-    if (cnx->f_binlog == NULL) {
+    if (!PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         return;
     }
     bytestream_buf stream_msg;
@@ -1271,8 +2528,8 @@ void picoquic_binlog_message_v(picoquic_cnx_t* cnx, const char* fmt, va_list var
 
     bytewrite_int32(ps_head, (uint32_t)bytestream_length(ps_msg));
 
-    (void)fwrite(bytestream_data(ps_head), bytestream_length(ps_head), 1, cnx->f_binlog);
-    (void)fwrite(bytestream_data(ps_msg), bytestream_length(ps_msg), 1, cnx->f_binlog);
+    binlog_write(cnx, cnx->f_binlog, bytestream_data(ps_head), bytestream_length(ps_head),
+        bytestream_data(ps_msg), bytestream_length(ps_msg));
 }
 
 /* Log an event that cannot be attached to a specific connection */
@@ -1302,17 +2559,30 @@ void binlog_ignore_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t curre
 /* Log an event relating to a specific connection */
 static void binlog_app_message(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
 {
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         picoquic_binlog_message_v(cnx, fmt, vargs);
     }
 }
 
 /* Return from close with nothing, as this is per connection only */
+static void binlog_log_policy_free(picoquic_quic_t* quic)
+{
+    if (quic->log_policy != NULL) {
+        picoquic_string_free(quic->log_policy->sni);
+        picoquic_string_free(quic->log_policy->alpn);
+        free(quic->log_policy);
+        quic->log_policy = NULL;
+    }
+}
+
 void binlog_close(picoquic_quic_t* quic)
 {
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(quic);
-#endif
+    if (quic->binlog_async != NULL) {
+        /* The writer thread drains the pending records before exiting */
+        binlog_async_delete(quic->binlog_async);
+        quic->binlog_async = NULL;
+    }
+    binlog_log_policy_free(quic);
 }
 
 struct st_picoquic_unified_logging_t binlog_functions = {
@@ -1348,3 +2618,103 @@ void picoquic_enable_binlog(picoquic_quic_t* quic)
 {
     quic->bin_log_fns = &binlog_functions;
 }
+
+int picoquic_set_binlog_async(picoquic_quic_t* quic, size_t ring_size, picoquic_binlog_async_policy_enum policy)
+{
+    int ret = 0;
+
+    if (quic->binlog_async != NULL) {
+        /* Changing the writer while connections are logging would reorder the records */
+        ret = -1;
+    }
+    else if ((quic->binlog_async = binlog_async_create(
+        (ring_size == 0) ? PICOQUIC_BINLOG_ASYNC_RING_DEFAULT : ring_size, policy)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        quic->bin_log_fns = &binlog_functions;
+    }
+
+    return ret;
+}
+
+int picoquic_set_binlog_compression(picoquic_quic_t* quic, size_t block_size)
+{
+    if (block_size > 0 && block_size < PICOQUIC_BINLOG_BLOCK_SIZE_MIN) {
+        block_size = PICOQUIC_BINLOG_BLOCK_SIZE_MIN;
+    }
+    else if (block_size > PICOQUIC_BINLOG_BLOCK_SIZE_MAX) {
+        block_size = PICOQUIC_BINLOG_BLOCK_SIZE_MAX;
+    }
+    quic->binlog_block_size = block_size;
+
+    return 0;
+}
+
+void picoquic_get_binlog_async_stats(picoquic_quic_t* quic, picoquic_binlog_async_stats_t* stats)
+{
+    if (quic->binlog_async == NULL) {
+        memset(stats, 0, sizeof(picoquic_binlog_async_stats_t));
+    }
+    else {
+        *stats = quic->binlog_async->stats;
+        stats->ring_size = quic->binlog_async->ring_size;
+    }
+}
+
+int picoquic_set_log_policy(picoquic_quic_t* quic, const picoquic_log_policy_t* policy)
+{
+    int ret = 0;
+
+    if (quic->log_policy == NULL) {
+        /* The context is kept until the QUIC context is freed, because
+         * connections in progress may still have records in memory. */
+        quic->log_policy = (picoquic_log_policy_ctx_t*)malloc(sizeof(picoquic_log_policy_ctx_t));
+        if (quic->log_policy == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(quic->log_policy, 0, sizeof(picoquic_log_policy_ctx_t));
+        }
+    }
+
+    if (ret == 0) {
+        quic->log_policy->sni = picoquic_string_free(quic->log_policy->sni);
+        quic->log_policy->alpn = picoquic_string_free(quic->log_policy->alpn);
+        if (policy == NULL) {
+            memset(&quic->log_policy->policy, 0, sizeof(picoquic_log_policy_t));
+        }
+        else if (policy->cid_prefix.id_len > PICOQUIC_CONNECTION_ID_MAX_SIZE) {
+            ret = -1;
+        }
+        else {
+            quic->log_policy->policy = *policy;
+            if ((policy->sni != NULL && (quic->log_policy->sni = picoquic_string_duplicate(policy->sni)) == NULL) ||
+                (policy->alpn != NULL && (quic->log_policy->alpn = picoquic_string_duplicate(policy->alpn)) == NULL)) {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+        }
+        quic->log_policy->policy.sni = quic->log_policy->sni;
+        quic->log_policy->policy.alpn = quic->log_policy->alpn;
+        quic->bin_log_fns = &binlog_functions;
+    }
+
+    return ret;
+}
+
+void picoquic_get_log_policy_stats(picoquic_quic_t* quic, picoquic_log_policy_stats_t* stats)
+{
+    if (quic->log_policy == NULL) {
+        memset(stats, 0, sizeof(picoquic_log_policy_stats_t));
+    }
+    else {
+        *stats = quic->log_policy->stats;
+    }
+}
+
+void picoquic_trigger_flight_recorder(picoquic_cnx_t* cnx)
+{
+    if (cnx->binlog_recorder != NULL && cnx->binlog_recorder->is_flight_recorder) {
+        binlog_recorder_flush(cnx);
+    }
+}
@@ -22,6 +22,7 @@
 #include "picoquic_internal.h"
 #include "picoquic_unified_log.h"
 #include "tls_api.h"
+#include "picoquic_probes.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -165,7 +166,6 @@ static picoquic_packet_t* picoquic_process_lost_packet(picoquic_cnx_t* cnx, pico
     picoquic_packet_t* packet, size_t send_buffer_max,
     size_t* length, int* packet_is_pure_ack, size_t * header_length);
 
-static int picoquic_is_packet_ack_eliciting(picoquic_packet_t* packet);
 
 static void picoquic_set_wake_up_from_packet_retransmit(
     picoquic_cnx_t* cnx, picoquic_packet_t* old_p, uint64_t current_time, uint64_t* next_wake_time);
@@ -177,7 +177,7 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
 {
     size_t length = 0;
 
-    if (pc == picoquic_packet_context_application && cnx->is_multipath_enabled) {
+    if (pc == picoquic_packet_context_application && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* If unique multipath is enabled, should check for retransmission on all paths */
         for (int i=0; i<cnx->nb_paths; i++) {
             if (length == 0) {
@@ -197,6 +197,8 @@ int picoquic_retransmit_needed(picoquic_cnx_t* cnx,
             packet, send_buffer_max, header_length);
     }
 
+    PICOQUIC_PROBE4(retransmit_needed, cnx, (int)pc, length, *next_wake_time);
+
     return (int)length;
 }
 
@@ -209,6 +211,17 @@ static size_t picoquic_retransmit_needed_loop(picoquic_cnx_t* cnx, picoquic_pack
     size_t length = 0;
     picoquic_packet_t* old_p = pkt_ctx->pending_first;
 
+    if (old_p != NULL && current_time < pkt_ctx->loss_check_time &&
+        old_p->sequence_number == pkt_ctx->loss_check_sequence && !cnx->initial_repeat_needed) {
+        /* No ACK arrived and the oldest packet did not change since the last
+         * evaluation, so nothing can be lost before the deadline. */
+        if (pkt_ctx->loss_check_time < *next_wake_time) {
+            *next_wake_time = pkt_ctx->loss_check_time;
+            SET_LAST_WAKE(cnx->quic, PICOQUIC_LOSS_RECOVERY);
+        }
+        continue_next = 0;
+    }
+
     /* Call the per packet routine in a loop */
     while (old_p != 0 && continue_next) {
         picoquic_packet_t* p_next = old_p->packet_next;
@@ -309,7 +322,7 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
 
     int is_probably_lost = 0;
     int is_timer_expired = 0;
-    uint64_t next_retransmit_time = *next_wake_time;
+    uint64_t next_retransmit_time = UINT64_MAX;
 
     length = 0;
 
@@ -375,6 +388,18 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
             *continue_next = 1;
         }
         else {
+            /* Remember the deadline, so that the queue is evaluated again only
+             * when it expires or when an ACK arrives. The safety timer of
+             * picoquic_is_packet_probably_lost depends on packets sent later,
+             * so the deadline is capped by its earliest value. */
+            uint64_t alt_retransmit_time = old_p->send_time + 2 * picoquic_current_retransmit_timer(cnx, old_path);
+
+            pkt_ctx->loss_check_time = next_retransmit_time;
+            if (old_path->nb_retransmit == 0 && alt_retransmit_time < pkt_ctx->loss_check_time) {
+                pkt_ctx->loss_check_time = alt_retransmit_time;
+            }
+            pkt_ctx->loss_check_sequence = old_p->sequence_number;
+
             if (next_retransmit_time < *next_wake_time) {
                 *next_wake_time = next_retransmit_time;
                 SET_LAST_WAKE(cnx->quic, PICOQUIC_LOSS_RECOVERY);
@@ -410,7 +435,7 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
              */
 
             /* If ack only packets are lost, bundle a ping next time an ACK is sent on that path */
-            if (old_p->send_path != NULL && cnx->is_multipath_enabled) {
+            if (old_p->send_path != NULL && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                 old_p->send_path->is_ack_lost = 1;
             }
             picoquic_count_and_notify_loss(cnx, old_p, 2, current_time);
@@ -454,7 +479,7 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
                     }
                     old_path->nb_retransmit++;
                     old_path->last_loss_event_detected = current_time;
-                    if (cnx->is_multipath_enabled && cnx->nb_paths > 1) {
+                    if (PICOQUIC_CNX_IS_MULTIPATH(cnx) && cnx->nb_paths > 1) {
                         picoquic_retransmit_path_packet_queue(cnx, old_path, pkt_ctx, current_time);
                     }
                     if (old_path->nb_retransmit > 9 &&
@@ -464,7 +489,7 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
                         picoquic_log_app_message(cnx, "%s", "Too many data retransmits (%"PRIu64"), abandon path %" PRIu64,
                             old_path->nb_retransmit, old_path->unique_path_id);
 
-                        if (cnx->is_multipath_enabled) {
+                        if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                             int all_paths_dubious = 1;
                             for (int path_id = 0; path_id < cnx->nb_paths; path_id++) {
                                 if (cnx->path[path_id]->nb_retransmit == 0) {
@@ -488,7 +513,7 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
                     cnx->cnx_state >= picoquic_state_ready) {
                     /* TODO: only disconnect if there is no other available path */
                     int all_paths_bad = 1;
-                    if (cnx->is_multipath_enabled) {
+                    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                         for (int path_id = 0; path_id < cnx->nb_paths; path_id++) {
                             if (cnx->path[path_id]->nb_retransmit <= 9) {
                                 all_paths_bad = 0;
@@ -538,6 +563,65 @@ static size_t picoquic_retransmit_needed_packet(picoquic_cnx_t* cnx, picoquic_pa
     return length;
 }
 
+/* Adaptive reordering window.
+ * The default RACK parameters declare a packet lost if a packet sent 3 numbers
+ * later is acknowledged, or if it is not acknowledged within 1/4th of the RTT
+ * after a later packet. On paths with reordering, for example ECMP paths, this
+ * causes spurious retransmissions and needless window reductions.
+ * As suggested in RFC 8985, each spurious retransmission increases the
+ * multiplier of the time window, at most once per RTT, and raises the packet
+ * threshold to the reordering gap observed. The values revert to the
+ * defaults after PICOQUIC_REORDER_WINDOW_PERSIST loss episodes without
+ * further spurious retransmissions.
+ */
+void picoquic_reorder_window_on_spurious(picoquic_path_t* path_x, uint64_t reorder_gap, uint64_t current_time)
+{
+    if (path_x->reorder_window_update_time == 0 ||
+        path_x->reorder_window_update_time + path_x->smoothed_rtt <= current_time) {
+        if (path_x->reorder_window_mult < PICOQUIC_REORDER_WINDOW_MULT_MAX) {
+            path_x->reorder_window_mult++;
+        }
+        path_x->reorder_window_update_time = current_time;
+    }
+    if (reorder_gap >= path_x->reorder_packet_threshold) {
+        path_x->reorder_packet_threshold = (reorder_gap < PICOQUIC_REORDER_PACKET_THRESHOLD_MAX) ?
+            reorder_gap + 1 : PICOQUIC_REORDER_PACKET_THRESHOLD_MAX;
+    }
+    path_x->reorder_window_persist = PICOQUIC_REORDER_WINDOW_PERSIST;
+}
+
+void picoquic_reorder_window_on_loss(picoquic_path_t* path_x, uint64_t current_time)
+{
+    /* Losses detected within the same RTT belong to the same episode */
+    if (path_x->reorder_window_persist > 0 &&
+        (path_x->reorder_loss_episode_time == 0 ||
+        path_x->reorder_loss_episode_time + path_x->smoothed_rtt <= current_time)) {
+        path_x->reorder_loss_episode_time = current_time;
+        path_x->reorder_window_persist--;
+        if (path_x->reorder_window_persist == 0) {
+            path_x->reorder_window_mult = 1;
+            path_x->reorder_packet_threshold = PICOQUIC_REORDER_PACKET_THRESHOLD;
+        }
+    }
+}
+
+uint64_t picoquic_reorder_window_delay(picoquic_path_t* path_x)
+{
+    uint64_t rack_delay = (path_x->smoothed_rtt >> 2);
+
+    if (rack_delay > PICOQUIC_RACK_DELAY / 2) {
+        rack_delay = PICOQUIC_RACK_DELAY / 2;
+    }
+    if (path_x->reorder_window_mult > 1) {
+        rack_delay *= path_x->reorder_window_mult;
+        if (rack_delay > path_x->smoothed_rtt) {
+            rack_delay = path_x->smoothed_rtt;
+        }
+    }
+
+    return rack_delay;
+}
+
 static int picoquic_is_packet_probably_lost(picoquic_cnx_t* cnx,
     picoquic_packet_t* old_p, uint64_t current_time, uint64_t* next_retransmit_time,
     int* is_timer_expired)
@@ -545,6 +629,7 @@ static int picoquic_is_packet_probably_lost(picoquic_cnx_t* cnx,
     uint64_t retransmit_time = UINT64_MAX;
     int64_t delta_seq = 0;
     int64_t delta_sent = 0;
+    int64_t packet_threshold = (int64_t)old_p->send_path->reorder_packet_threshold;
     uint64_t rack_timer_min;
     int is_probably_lost = 0;
 
@@ -567,11 +652,16 @@ static int picoquic_is_packet_probably_lost(picoquic_cnx_t* cnx,
         retransmit_time = current_time + old_p->send_path->smoothed_rtt + PICOQUIC_RACK_DELAY;
     }
     else {
-        picoquic_packet_context_t* pkt_ctx = (cnx->is_multipath_enabled && old_p->pc == picoquic_packet_context_application) ?
+        picoquic_packet_context_t* pkt_ctx = (PICOQUIC_CNX_IS_MULTIPATH(cnx) && old_p->pc == picoquic_packet_context_application) ?
             &old_p->send_path->pkt_ctx : &cnx->pkt_ctx[old_p->pc];
         delta_seq = pkt_ctx->highest_acknowledged - old_p->sequence_number;
 
-        if (delta_seq >= 3) {
+        if (delta_seq >= packet_threshold && old_p->is_fec_protected && cnx->is_fec_negotiated &&
+            current_time < picoquic_fec_recovery_deadline(cnx, old_p)) {
+            /* Leave time for the peer to rebuild the packet from the repair frame */
+            retransmit_time = picoquic_fec_recovery_deadline(cnx, old_p);
+        }
+        else if (delta_seq >= packet_threshold) {
             /* Last acknowledged packet is ways ahead. That means this packet
             * is most probably lost.
             */
@@ -580,11 +670,8 @@ static int picoquic_is_packet_probably_lost(picoquic_cnx_t* cnx,
         }
         else if (delta_seq > 0) {
             /* Set a timer relative to that last packet */
-            int64_t rack_delay = (old_p->send_path->smoothed_rtt >> 2);
+            int64_t rack_delay = (int64_t)picoquic_reorder_window_delay(old_p->send_path);
             delta_sent = pkt_ctx->latest_time_acknowledged - old_p->send_time;
-            if (rack_delay > PICOQUIC_RACK_DELAY / 2) {
-                rack_delay = PICOQUIC_RACK_DELAY / 2;
-            }
             retransmit_time = old_p->send_time + old_p->send_path->retransmit_timer;
             rack_timer_min = pkt_ctx->highest_acknowledged_time + rack_delay
                 - delta_sent + cnx->remote_parameters.max_ack_delay;
@@ -707,6 +794,12 @@ int picoquic_copy_before_retransmit(picoquic_packet_t * old_p,
             old_p->send_path->mtu_probe_sent = 0;
             if (!force_queue || force_queue == 2) {
                 old_p->send_path->send_mtu_max_tried = old_p->length + old_p->checksum_overhead;
+                if (old_p->send_path->send_mtu_cached > 0 &&
+                    old_p->send_path->send_mtu_max_tried <= old_p->send_path->send_mtu_cached) {
+                    /* The cached value does not work anymore */
+                    old_p->send_path->send_mtu_cached = 0;
+                    picoquic_pmtu_cache_forget(cnx->quic, (struct sockaddr*)&old_p->send_path->first_tuple->peer_addr);
+                }
             }
         }
         /* MTU probes should not be retransmitted */
@@ -762,8 +855,19 @@ int picoquic_copy_before_retransmit(picoquic_packet_t * old_p,
             /* Prepare retransmission if needed */
             if (ret == 0) {
                 if (!frame_is_pure_ack) {
-                    if (PICOQUIC_IN_RANGE(old_p->bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
-                        * add_to_data_repeat_queue = 1;
+                    if (picoquic_is_stream_metadata_frame(&old_p->bytes[byte_index], frame_length)) {
+                        /* The stream data was stripped after sending, the frame is rebuilt from the stream */
+                        if (picoquic_queue_stream_metadata_repeat(cnx, &old_p->bytes[byte_index], frame_length) != 0) {
+                            ret = picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0,
+                                "retained stream data missing, cannot be resent");
+                        }
+                    }
+                    else if (PICOQUIC_IN_RANGE(old_p->bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max)) {
+                        if (!cnx->is_stream_repeat_from_queue ||
+                            picoquic_queue_stream_frame_repeat(cnx, &old_p->bytes[byte_index], frame_length) != 0) {
+                            /* The frame will be copied from the packet */
+                            *add_to_data_repeat_queue = 1;
+                        }
                     }
                     else {
                         if ((force_queue || frame_length > send_buffer_max_minus_checksum - *length)) {
@@ -864,7 +968,7 @@ static picoquic_packet_t* picoquic_process_lost_packet(picoquic_cnx_t* cnx, pico
     }
 
     /* If ack only packets are lost, bundle a ping next time an ACK is sent on that path */
-    if (old_p->send_path != NULL && cnx->is_multipath_enabled) {
+    if (old_p->send_path != NULL && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         old_p->send_path->is_ack_lost = 1;
     }
 
@@ -886,7 +990,7 @@ static void picoquic_check_path_mtu_on_losses(
     picoquic_cnx_t* cnx, picoquic_packet_t* old_p, int timer_based_retransmit)
 {
     if (old_p->send_path != NULL &&
-        ((old_p->length + old_p->checksum_overhead) == old_p->send_path->send_mtu || timer_based_retransmit) &&
+        ((PICOQUIC_PACKET_SENT_LENGTH(old_p) + old_p->checksum_overhead) == old_p->send_path->send_mtu || timer_based_retransmit) &&
         cnx->cnx_state >= picoquic_state_ready) {
 #if 1
         if (old_p->sequence_number >= 152 && old_p->send_path->unique_path_id == 1) {
@@ -916,10 +1020,15 @@ static void picoquic_count_and_notify_loss(
         picoquic_log_packet_lost(cnx, old_p->send_path, old_p->ptype, old_p->sequence_number,
             (timer_based_retransmit) ? "timer" : "repeat",
             (old_p->send_path == NULL || old_p->send_path->first_tuple->p_remote_cnxid == NULL) ? NULL : &old_p->send_path->first_tuple->p_remote_cnxid->cnx_id,
-            old_p->length, current_time);
+            PICOQUIC_PACKET_SENT_LENGTH(old_p), current_time);
+        PICOQUIC_PROBE6(packet_lost, cnx, (old_p->send_path == NULL) ? 0 : old_p->send_path->unique_path_id,
+            old_p->sequence_number, (int)old_p->ptype, PICOQUIC_PACKET_SENT_LENGTH(old_p), timer_based_retransmit);
 
         if (!old_p->is_preemptive_repeat) {
             cnx->nb_retransmission_total++;
+            if (cnx->quic->metrics != NULL) {
+                cnx->quic->metrics->live.nb_packets_lost++;
+            }
         }
     }
 
@@ -928,26 +1037,31 @@ static void picoquic_count_and_notify_loss(
         if (timer_based_retransmit) {
             old_p->send_path->nb_timer_losses++;
         }
+        else {
+            picoquic_reorder_window_on_loss(old_p->send_path, current_time);
+        }
         if ((old_p->send_path->smoothed_rtt != PICOQUIC_INITIAL_RTT ||
             old_p->send_path->rtt_variant != 0) &&
             old_p->send_time > cnx->start_time + old_p->send_path->smoothed_rtt) {
             /* we do not count losses occruring before ready state, because the 
              * timers are not reliable yet */
-            old_p->send_path->total_bytes_lost += old_p->length;
+            old_p->send_path->total_bytes_lost += PICOQUIC_PACKET_SENT_LENGTH(old_p);
         }
 
         if (cnx->congestion_alg != NULL && cnx->cnx_state >= picoquic_state_ready && old_p->send_path != NULL) {
             picoquic_per_ack_state_t ack_state = { 0 };
             ack_state.lost_packet_number = old_p->sequence_number;
-            ack_state.nb_bytes_newly_lost = old_p->length;
+            ack_state.nb_bytes_newly_lost = PICOQUIC_PACKET_SENT_LENGTH(old_p);
             cnx->congestion_alg->alg_notify(cnx, old_p->send_path,
                 (timer_based_retransmit == 0) ? picoquic_congestion_notification_repeat : picoquic_congestion_notification_timeout,
                 &ack_state, current_time);
+            PICOQUIC_PROBE_CC_NOTIFY(cnx, old_p->send_path, (timer_based_retransmit == 0) ?
+                picoquic_congestion_notification_repeat : picoquic_congestion_notification_timeout);
         }
     }
 }
 
-static int picoquic_is_packet_ack_eliciting(picoquic_packet_t * packet)
+int picoquic_is_packet_ack_eliciting(picoquic_packet_t * packet)
 {
     /* check if this is an ACK eliciting packet */
     int is_ack_eliciting = 0;
@@ -1007,7 +1121,7 @@ static void picoquic_retransmit_path_packet_queue(picoquic_cnx_t* cnx, picoquic_
         }
 
         /* If ack only packets are lost, bundle a ping next time an ACK is sent on that path */
-        if (old_p->send_path != NULL && cnx->is_multipath_enabled) {
+        if (old_p->send_path != NULL && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
             old_p->send_path->is_ack_lost = 1;
         }
 
@@ -1029,7 +1143,7 @@ void picoquic_retransmit_demoted_path(picoquic_cnx_t* cnx, picoquic_path_t* path
     picoquic_packet_context_t* pkt_ctx = NULL;
 
     if (cnx->cnx_state == picoquic_state_ready && cnx->nb_paths > 1) {
-        if (cnx->is_multipath_enabled) {
+        if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
             pkt_ctx = &path_x->pkt_ctx;
         }
         else {
@@ -1051,7 +1165,7 @@ void picoquic_queue_retransmit_on_ack(picoquic_cnx_t* cnx, picoquic_path_t* path
 
     /* If multipath, pick the packet context associated with the current path,
      * else, pick the default 1RTT context */
-    if (cnx->is_multipath_enabled) {
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         pkt_ctx = &path_x->pkt_ctx;
     }
     else {
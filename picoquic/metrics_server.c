@@ -0,0 +1,261 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Embedded OpenMetrics endpoint.
+*
+* The server runs in its own thread, so that scraping the metrics never
+* delays the network thread. It accepts one TCP connection at a time,
+* reads the HTTP request, and answers "GET /metrics" with the last
+* snapshot published by the network thread, formatted as OpenMetrics
+* text. The connection is closed after each response. The thread checks
+* the stop flag at least every PICOQUIC_METRICS_SERVER_POLL_MS.
+*
+* By default, the server only listens on the IPv4 loopback address.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picosocks.h"
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picoquic_packet_loop.h"
+
+#define PICOQUIC_METRICS_SERVER_POLL_MS 100
+#define PICOQUIC_METRICS_SERVER_TIMEOUT_MS 1000
+#define PICOQUIC_METRICS_SERVER_REQUEST_MAX 2048
+#define PICOQUIC_METRICS_SERVER_TEXT_MAX 32768
+#define PICOQUIC_METRICS_SERVER_HEADER_MAX 256
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct st_picoquic_metrics_server_t {
+    picoquic_quic_t* quic;
+    SOCKET_TYPE fd;
+    uint16_t port;
+    volatile int should_stop;
+    int is_thread_started;
+    picoquic_thread_t thread;
+    char request[PICOQUIC_METRICS_SERVER_REQUEST_MAX];
+    char text[PICOQUIC_METRICS_SERVER_TEXT_MAX];
+    char header[PICOQUIC_METRICS_SERVER_HEADER_MAX];
+};
+
+static int picoquic_metrics_server_send_all(SOCKET_TYPE fd, const char* data, size_t length)
+{
+    int ret = 0;
+
+    while (ret == 0 && length > 0) {
+        int sent = (int)send(fd, data, (int)length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            ret = -1;
+        }
+        else {
+            data += sent;
+            length -= (size_t)sent;
+        }
+    }
+
+    return ret;
+}
+
+/* Read until the end of the request headers. The request body,
+ * if any, is ignored. */
+static size_t picoquic_metrics_server_read_request(picoquic_metrics_server_t* server, SOCKET_TYPE fd)
+{
+    size_t length = 0;
+#ifdef _WINDOWS
+    DWORD timeout = PICOQUIC_METRICS_SERVER_TIMEOUT_MS;
+#else
+    struct timeval timeout = { PICOQUIC_METRICS_SERVER_TIMEOUT_MS / 1000, (PICOQUIC_METRICS_SERVER_TIMEOUT_MS % 1000) * 1000 };
+#endif
+
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    while (length < PICOQUIC_METRICS_SERVER_REQUEST_MAX - 1) {
+        int nb_read = (int)recv(fd, server->request + length, (int)(PICOQUIC_METRICS_SERVER_REQUEST_MAX - 1 - length), 0);
+        if (nb_read <= 0) {
+            break;
+        }
+        length += (size_t)nb_read;
+        server->request[length] = 0;
+        if (strstr(server->request, "\r\n\r\n") != NULL || strstr(server->request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    server->request[length] = 0;
+
+    return length;
+}
+
+static int picoquic_metrics_server_is_metrics_path(const char* request)
+{
+    const char* path = request + 4;
+    size_t path_length = strcspn(path, " ?\r\n");
+
+    return (path_length == 1 && path[0] == '/') ||
+        (path_length == 8 && memcmp(path, "/metrics", 8) == 0);
+}
+
+static void picoquic_metrics_server_reply(picoquic_metrics_server_t* server, SOCKET_TYPE fd)
+{
+    char const* status = "200 OK";
+    char const* content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    size_t text_length = 0;
+    size_t header_length = 0;
+
+    if (picoquic_metrics_server_read_request(server, fd) < 4 || memcmp(server->request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    }
+    else if (!picoquic_metrics_server_is_metrics_path(server->request)) {
+        status = "404 Not Found";
+    }
+    else {
+        picoquic_quic_metrics_t metrics;
+
+        if (picoquic_get_quic_metrics(server->quic, &metrics) != 0 ||
+            (text_length = picoquic_format_openmetrics(&metrics, server->text, sizeof(server->text))) == 0) {
+            status = "503 Service Unavailable";
+        }
+    }
+    if (text_length == 0) {
+        content_type = "text/plain";
+    }
+
+    if (picoquic_sprintf(server->header, sizeof(server->header), &header_length,
+        "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %" PRIst "\r\nConnection: close\r\n\r\n",
+        status, content_type, text_length) == 0 &&
+        picoquic_metrics_server_send_all(fd, server->header, header_length) == 0 && text_length > 0) {
+        (void)picoquic_metrics_server_send_all(fd, server->text, text_length);
+    }
+}
+
+static picoquic_thread_return_t picoquic_metrics_server_thread(void* v_server)
+{
+    picoquic_metrics_server_t* server = (picoquic_metrics_server_t*)v_server;
+
+    while (!server->should_stop) {
+        fd_set readfds;
+        struct timeval tv = { 0, PICOQUIC_METRICS_SERVER_POLL_MS * 1000 };
+
+        FD_ZERO(&readfds);
+        FD_SET(server->fd, &readfds);
+        if (select((int)server->fd + 1, &readfds, NULL, NULL, &tv) > 0 && !server->should_stop) {
+            SOCKET_TYPE fd = accept(server->fd, NULL, NULL);
+
+            if (fd != INVALID_SOCKET) {
+                picoquic_metrics_server_reply(server, fd);
+                SOCKET_CLOSE(fd);
+            }
+        }
+    }
+
+    picoquic_thread_do_return;
+}
+
+static int picoquic_metrics_server_listen(picoquic_metrics_server_t* server, uint16_t port, int bind_any)
+{
+    int ret = 0;
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    int val = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl((bind_any) ? INADDR_ANY : INADDR_LOOPBACK);
+
+    if ((server->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET) {
+        ret = -1;
+    }
+    else if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&val, sizeof(val)) != 0 ||
+        bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(server->fd, 8) != 0 ||
+        getsockname(server->fd, (struct sockaddr*)&addr, &addr_length) != 0) {
+        DBG_PRINTF("Cannot listen for metrics on port %d, error %d", (int)port, (int)WSA_LAST_ERROR(errno));
+        ret = -1;
+    }
+    else {
+        server->port = ntohs(addr.sin_port);
+    }
+
+    return ret;
+}
+
+/* Port 0 selects an ephemeral port, see picoquic_metrics_server_port.
+ * Metrics are enabled with the default publish interval if they were not
+ * enabled yet. This must be called before starting the network thread. */
+picoquic_metrics_server_t* picoquic_start_metrics_server(picoquic_quic_t* quic, uint16_t port, int bind_any, int* ret)
+{
+    picoquic_metrics_server_t* server = (picoquic_metrics_server_t*)malloc(sizeof(picoquic_metrics_server_t));
+
+    *ret = 0;
+    if (server == NULL) {
+        *ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(server, 0, sizeof(picoquic_metrics_server_t));
+        server->quic = quic;
+        server->fd = INVALID_SOCKET;
+
+        if (quic->metrics == NULL) {
+            *ret = picoquic_enable_quic_metrics(quic, 0);
+        }
+        if (*ret == 0) {
+            *ret = picoquic_metrics_server_listen(server, port, bind_any);
+        }
+        if (*ret == 0) {
+            if ((*ret = picoquic_create_thread(&server->thread, picoquic_metrics_server_thread, server)) == 0) {
+                server->is_thread_started = 1;
+            }
+        }
+        if (*ret != 0) {
+            picoquic_stop_metrics_server(server);
+            server = NULL;
+        }
+    }
+
+    return server;
+}
+
+uint16_t picoquic_metrics_server_port(picoquic_metrics_server_t* server)
+{
+    return server->port;
+}
+
+void picoquic_stop_metrics_server(picoquic_metrics_server_t* server)
+{
+    if (server != NULL) {
+        server->should_stop = 1;
+        if (server->is_thread_started) {
+            picoquic_delete_thread(&server->thread);
+            server->is_thread_started = 0;
+        }
+        if (server->fd != INVALID_SOCKET) {
+            SOCKET_CLOSE(server->fd);
+            server->fd = INVALID_SOCKET;
+        }
+        free(server);
+    }
+}
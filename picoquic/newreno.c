@@ -177,12 +177,14 @@ void picoquic_newreno_sim_notify(
 typedef struct st_picoquic_newreno_state_t {
     picoquic_newreno_sim_state_t nrss;
     picoquic_min_max_rtt_t rtt_filter;
+    picoquic_hystart_pp_t hspp;
 } picoquic_newreno_state_t;
 
 static void picoquic_newreno_reset(picoquic_newreno_state_t* nr_state, picoquic_path_t* path_x)
 {
     memset(nr_state, 0, sizeof(picoquic_newreno_state_t));
     picoquic_newreno_sim_reset(&nr_state->nrss);
+    picoquic_hystart_pp_reset(&nr_state->hspp, path_x->cnx, path_x);
     path_x->cwin = nr_state->nrss.cwin;
 }
 
@@ -223,6 +225,9 @@ static void picoquic_newreno_notify(
     path_x->is_cc_data_updated = 1;
 
     if (nr_state != NULL) {
+        int is_initial_slow_start = (nr_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
+            nr_state->nrss.ssthresh == UINT64_MAX);
+
         switch (notification) {
         /* RTT measurements will happen before acknowledgement is signalled */
         case picoquic_congestion_notification_acknowledgement:
@@ -235,7 +240,15 @@ static void picoquic_newreno_notify(
 
             if (path_x->last_time_acked_data_frame_sent > path_x->last_sender_limited_time) {
                 /* TODO app limited. */
-                picoquic_newreno_sim_notify(&nr_state->nrss, cnx, path_x, notification, ack_state, current_time);
+                if (is_initial_slow_start && picoquic_hystart_pp_in_css(&nr_state->hspp)) {
+                    /* HyStart++ conservative slow start: slower growth */
+                    picoquic_per_ack_state_t css_ack_state = *ack_state;
+                    css_ack_state.nb_bytes_acknowledged /= PICOQUIC_HYSTART_PP_CSS_GROWTH_DIVISOR;
+                    picoquic_newreno_sim_notify(&nr_state->nrss, cnx, path_x, notification, &css_ack_state, current_time);
+                }
+                else {
+                    picoquic_newreno_sim_notify(&nr_state->nrss, cnx, path_x, notification, ack_state, current_time);
+                }
                 path_x->cwin = nr_state->nrss.cwin;
             }
             break;
@@ -270,9 +283,11 @@ static void picoquic_newreno_notify(
                     nr_state->nrss.cwin = path_x->cwin;
                 }
 
-                /* HyStart. */
+                /* HyStart, or HyStart++ if enabled. */
                 /* Using RTT increases as signal to get out of initial slow start */
-                if (picoquic_cc_hystart_test(&nr_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
+                if ((nr_state->hspp.is_enabled) ?
+                    picoquic_hystart_pp_test(&nr_state->hspp, cnx, path_x, ack_state->rtt_measurement) :
+                    picoquic_cc_hystart_test(&nr_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
                     cnx->path[0]->pacing.packet_time_microsec, current_time, cnx->is_time_stamp_enabled)) {
                     /* RTT increased too much, get out of slow start! */
                     nr_state->nrss.ssthresh = nr_state->nrss.cwin;
@@ -290,6 +305,10 @@ static void picoquic_newreno_notify(
             break;
         }
 
+        if (is_initial_slow_start && nr_state->nrss.ssthresh != UINT64_MAX) {
+            picoquic_cc_record_slow_start_exit(path_x, &nr_state->hspp, notification, current_time);
+        }
+
         /* Compute pacing data */
         picoquic_update_pacing_data(cnx, path_x, nr_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
             nr_state->nrss.ssthresh == UINT64_MAX);
@@ -314,6 +333,54 @@ void picoquic_newreno_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint6
     *cc_param = (nr_state->nrss.ssthresh == UINT64_MAX) ? 0 : nr_state->nrss.ssthresh;
 }
 
+/* Export and import the state of congestion control.
+ * The congestion window is part of the path values, so the snapshot only
+ * contains the algorithm state, the slow start threshold and the residual ack.
+ */
+static uint8_t* picoquic_newreno_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_newreno_state_t* nr_state = (picoquic_newreno_state_t*)path_x->congestion_alg_state;
+    uint64_t values[3];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    values[0] = (uint64_t)nr_state->nrss.alg_state;
+    values[1] = nr_state->nrss.ssthresh;
+    values[2] = nr_state->nrss.residual_ack;
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 3);
+}
+
+static const uint8_t* picoquic_newreno_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_newreno_state_t* nr_state = (picoquic_newreno_state_t*)path_x->congestion_alg_state;
+    uint64_t values[3];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 3)) != NULL) {
+        if (values[0] > picoquic_newreno_alg_congestion_avoidance) {
+            bytes = NULL;
+        }
+        else {
+            nr_state->nrss.alg_state = (picoquic_newreno_alg_state_t)values[0];
+            nr_state->nrss.ssthresh = values[1];
+            nr_state->nrss.residual_ack = values[2];
+            nr_state->nrss.cwin = path_x->cwin;
+            /* Losses of packets sent before the import do not trigger a new recovery,
+             * and there is no recovery period to correct on spurious repeats. */
+            nr_state->nrss.recovery_start = 0;
+            nr_state->nrss.recovery_sequence = picoquic_cc_get_sequence_number(cnx, path_x);
+            picoquic_update_pacing_data(cnx, path_x, nr_state->nrss.alg_state == picoquic_newreno_alg_slow_start &&
+                nr_state->nrss.ssthresh == UINT64_MAX);
+        }
+    }
+
+    return bytes;
+}
+
 /* Definition record for the New Reno algorithm */
 
 #define PICOQUIC_NEWRENO_ID "newreno" /* NR88 */
@@ -323,7 +390,9 @@ picoquic_congestion_algorithm_t picoquic_newreno_algorithm_struct = {
     picoquic_newreno_init,
     picoquic_newreno_notify,
     picoquic_newreno_delete,
-    picoquic_newreno_observe
+    picoquic_newreno_observe,
+    picoquic_newreno_export,
+    picoquic_newreno_import
 };
 
 picoquic_congestion_algorithm_t* picoquic_newreno_algorithm = &picoquic_newreno_algorithm_struct;
@@ -0,0 +1,475 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Pools of fixed size objects used by the stack: connection contexts,
+ * paths, tuples, stream heads, connection IDs, and size classes for the
+ * queued misc frames and datagrams. Free objects are kept
+ * in a per type list, so that connection setup and tear down at high rates
+ * does not pound on the memory allocator.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+static void* picoquic_object_default_alloc(void* allocator_ctx, size_t size)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(allocator_ctx);
+#endif
+    return malloc(size);
+}
+
+static void picoquic_object_default_free(void* allocator_ctx, void* object, size_t size)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(allocator_ctx);
+    UNREFERENCED_PARAMETER(size);
+#endif
+    free(object);
+}
+
+void picoquic_object_pools_init(picoquic_quic_t* quic)
+{
+    static const size_t object_size[picoquic_object_type_max] = {
+        sizeof(picoquic_cnx_t),
+        sizeof(picoquic_path_t),
+        sizeof(picoquic_tuple_t),
+        sizeof(picoquic_stream_head_t),
+        sizeof(picoquic_local_cnxid_t),
+        sizeof(picoquic_remote_cnxid_t),
+        sizeof(picoquic_misc_frame_header_t) + PICOQUIC_MISC_FRAME_SMALL_SIZE,
+        sizeof(picoquic_misc_frame_header_t) + PICOQUIC_MISC_FRAME_MEDIUM_SIZE,
+        sizeof(picoquic_misc_frame_header_t) + PICOQUIC_MISC_FRAME_LARGE_SIZE
+    };
+
+    for (int i = 0; i < picoquic_object_type_max; i++) {
+        memset(&quic->object_pool[i], 0, sizeof(picoquic_object_pool_t));
+        quic->object_pool[i].stats.object_size = object_size[i];
+        quic->object_pool[i].stats.max_in_pool = PICOQUIC_DEFAULT_OBJECTS_IN_POOL;
+    }
+    quic->object_alloc_fn = picoquic_object_default_alloc;
+    quic->object_free_fn = picoquic_object_default_free;
+    quic->object_allocator_ctx = NULL;
+    quic->tuning.max_packets_in_pool = PICOQUIC_MAX_PACKETS_IN_POOL;
+    quic->tuning.max_data_nodes_in_pool = PICOQUIC_MAX_PACKETS_IN_POOL;
+}
+
+static void picoquic_object_pool_trim(picoquic_quic_t* quic, picoquic_object_pool_t* pool, size_t nb_kept)
+{
+    while (pool->stats.nb_in_pool > nb_kept && pool->first_free != NULL) {
+        void* object = pool->first_free;
+        pool->first_free = *(void**)object;
+        pool->stats.nb_in_pool--;
+        quic->object_free_fn(quic->object_allocator_ctx, object, pool->stats.object_size);
+    }
+}
+
+void picoquic_object_pools_release(picoquic_quic_t* quic)
+{
+    for (int i = 0; i < picoquic_object_type_max; i++) {
+        picoquic_object_pool_trim(quic, &quic->object_pool[i], 0);
+    }
+}
+
+void* picoquic_object_alloc(picoquic_quic_t* quic, picoquic_object_type_enum object_type)
+{
+    picoquic_object_pool_t* pool = &quic->object_pool[object_type];
+    void* object = pool->first_free;
+
+    if (object != NULL) {
+        pool->first_free = *(void**)object;
+        pool->stats.nb_in_pool--;
+        pool->stats.nb_alloc_from_pool++;
+    }
+    else {
+        object = quic->object_alloc_fn(quic->object_allocator_ctx, pool->stats.object_size);
+    }
+
+    if (object != NULL) {
+        memset(object, 0, pool->stats.object_size);
+        pool->stats.nb_alloc++;
+        pool->stats.nb_in_use++;
+        if (pool->stats.nb_in_use > pool->stats.nb_in_use_max) {
+            pool->stats.nb_in_use_max = pool->stats.nb_in_use;
+        }
+    }
+
+    return object;
+}
+
+void picoquic_object_free(picoquic_quic_t* quic, picoquic_object_type_enum object_type, void* object)
+{
+    if (object != NULL) {
+        picoquic_object_pool_t* pool = &quic->object_pool[object_type];
+
+        pool->stats.nb_in_use--;
+        if (pool->stats.nb_in_pool < pool->stats.max_in_pool) {
+            *(void**)object = pool->first_free;
+            pool->first_free = object;
+            pool->stats.nb_in_pool++;
+        }
+        else {
+            quic->object_free_fn(quic->object_allocator_ctx, object, pool->stats.object_size);
+        }
+    }
+}
+
+/* Misc frames are allocated from the smallest size class that fits the
+ * content. Larger frames, which cannot fit in a packet anyway, fall back
+ * to malloc. Only the header is cleared.
+ */
+picoquic_misc_frame_header_t* picoquic_misc_frame_alloc(picoquic_quic_t* quic, size_t length)
+{
+    picoquic_misc_frame_header_t* frame = NULL;
+    picoquic_object_type_enum object_type = picoquic_object_type_max;
+
+    if (length <= PICOQUIC_MISC_FRAME_SMALL_SIZE) {
+        object_type = picoquic_object_misc_frame_small;
+    }
+    else if (length <= PICOQUIC_MISC_FRAME_MEDIUM_SIZE) {
+        object_type = picoquic_object_misc_frame_medium;
+    }
+    else if (length <= PICOQUIC_MISC_FRAME_LARGE_SIZE) {
+        object_type = picoquic_object_misc_frame_large;
+    }
+
+    if (object_type == picoquic_object_type_max) {
+        frame = (picoquic_misc_frame_header_t*)malloc(sizeof(picoquic_misc_frame_header_t) + length);
+    }
+    else {
+        picoquic_object_pool_t* pool = &quic->object_pool[object_type];
+
+        if ((frame = (picoquic_misc_frame_header_t*)pool->first_free) != NULL) {
+            pool->first_free = *(void**)frame;
+            pool->stats.nb_in_pool--;
+            pool->stats.nb_alloc_from_pool++;
+        }
+        else {
+            frame = (picoquic_misc_frame_header_t*)quic->object_alloc_fn(quic->object_allocator_ctx, pool->stats.object_size);
+        }
+        if (frame != NULL) {
+            pool->stats.nb_alloc++;
+            pool->stats.nb_in_use++;
+            if (pool->stats.nb_in_use > pool->stats.nb_in_use_max) {
+                pool->stats.nb_in_use_max = pool->stats.nb_in_use;
+            }
+        }
+    }
+
+    if (frame != NULL) {
+        memset(frame, 0, sizeof(picoquic_misc_frame_header_t));
+        frame->object_type = object_type;
+    }
+
+    return frame;
+}
+
+void picoquic_misc_frame_free(picoquic_quic_t* quic, picoquic_misc_frame_header_t* frame)
+{
+    if (frame != NULL) {
+        if (frame->object_type == picoquic_object_type_max) {
+            free(frame);
+        }
+        else {
+            picoquic_object_free(quic, frame->object_type, frame);
+        }
+    }
+}
+
+int picoquic_set_object_allocator(picoquic_quic_t* quic, picoquic_object_alloc_fn alloc_fn,
+    picoquic_object_free_fn free_fn, void* allocator_ctx)
+{
+    int ret = 0;
+
+    for (int i = 0; i < picoquic_object_type_max; i++) {
+        if (quic->object_pool[i].stats.nb_in_use > 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        /* Objects in the pools were obtained from the previous backend */
+        picoquic_object_pools_release(quic);
+        if (alloc_fn == NULL || free_fn == NULL) {
+            quic->object_alloc_fn = picoquic_object_default_alloc;
+            quic->object_free_fn = picoquic_object_default_free;
+            quic->object_allocator_ctx = NULL;
+        }
+        else {
+            quic->object_alloc_fn = alloc_fn;
+            quic->object_free_fn = free_fn;
+            quic->object_allocator_ctx = allocator_ctx;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_set_object_pool_size(picoquic_quic_t* quic, picoquic_object_type_enum object_type, size_t max_in_pool)
+{
+    int ret = 0;
+
+    if (object_type >= picoquic_object_type_max) {
+        ret = -1;
+    }
+    else {
+        quic->object_pool[object_type].stats.max_in_pool = max_in_pool;
+        picoquic_object_pool_trim(quic, &quic->object_pool[object_type], max_in_pool);
+    }
+
+    return ret;
+}
+
+int picoquic_preallocate_objects(picoquic_quic_t* quic, picoquic_object_type_enum object_type, size_t nb_objects)
+{
+    int ret = 0;
+
+    if (object_type >= picoquic_object_type_max) {
+        ret = -1;
+    }
+    else {
+        picoquic_object_pool_t* pool = &quic->object_pool[object_type];
+
+        if (pool->stats.max_in_pool < nb_objects) {
+            pool->stats.max_in_pool = nb_objects;
+        }
+        while (pool->stats.nb_in_pool < nb_objects) {
+            void* object = quic->object_alloc_fn(quic->object_allocator_ctx, pool->stats.object_size);
+            if (object == NULL) {
+                ret = PICOQUIC_ERROR_MEMORY;
+                break;
+            }
+            *(void**)object = pool->first_free;
+            pool->first_free = object;
+            pool->stats.nb_in_pool++;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_get_object_pool_stats(picoquic_quic_t* quic, picoquic_object_type_enum object_type,
+    picoquic_object_pool_stats_t* stats)
+{
+    int ret = 0;
+
+    if (object_type >= picoquic_object_type_max) {
+        ret = -1;
+    }
+    else {
+        *stats = quic->object_pool[object_type].stats;
+    }
+
+    return ret;
+}
+
+/* Prewarming of the packet and data node pools.
+ * The objects are either allocated one by one with malloc, or carved from
+ * a single slab. On Linux, the slab is mapped with MAP_HUGETLB if huge pages
+ * are reserved on the system, or else with a regular mapping marked with
+ * MADV_HUGEPAGE so that transparent huge pages can be used. Other systems
+ * fall back to a plain malloc'ed slab.
+ */
+#define PICOQUIC_PREWARM_STRIDE(size) (((size) + 15) & ~((size_t)15))
+#define PICOQUIC_HUGE_PAGE_SIZE 0x200000
+
+static uint8_t* picoquic_prewarm_slab_alloc(picoquic_quic_t* quic, size_t size)
+{
+    picoquic_prewarm_slab_t* slab = (picoquic_prewarm_slab_t*)malloc(sizeof(picoquic_prewarm_slab_t));
+
+    if (slab != NULL) {
+        memset(slab, 0, sizeof(picoquic_prewarm_slab_t));
+#ifdef __linux__
+        slab->size = (size + PICOQUIC_HUGE_PAGE_SIZE - 1) & ~((size_t)PICOQUIC_HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        slab->base = (uint8_t*)mmap(NULL, slab->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab->base == (uint8_t*)MAP_FAILED) {
+            slab->base = NULL;
+        }
+#endif
+        if (slab->base == NULL) {
+            slab->base = (uint8_t*)mmap(NULL, slab->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab->base == (uint8_t*)MAP_FAILED) {
+                slab->base = NULL;
+            }
+#ifdef MADV_HUGEPAGE
+            else {
+                (void)madvise(slab->base, slab->size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        slab->is_mapped = (slab->base != NULL);
+#endif
+        if (slab->base == NULL) {
+            slab->size = size;
+            slab->base = (uint8_t*)malloc(size);
+        }
+        if (slab->base == NULL) {
+            free(slab);
+            slab = NULL;
+        }
+        else {
+            slab->next_slab = quic->prewarm_slabs;
+            quic->prewarm_slabs = slab;
+        }
+    }
+
+    return (slab == NULL) ? NULL : slab->base;
+}
+
+int picoquic_is_prewarmed(picoquic_quic_t* quic, const void* object)
+{
+    int is_prewarmed = 0;
+    picoquic_prewarm_slab_t* slab = quic->prewarm_slabs;
+
+    while (slab != NULL) {
+        if ((const uint8_t*)object >= slab->base && (const uint8_t*)object < slab->base + slab->size) {
+            is_prewarmed = 1;
+            break;
+        }
+        slab = slab->next_slab;
+    }
+
+    return is_prewarmed;
+}
+
+void picoquic_prewarm_slabs_release(picoquic_quic_t* quic)
+{
+    while (quic->prewarm_slabs != NULL) {
+        picoquic_prewarm_slab_t* slab = quic->prewarm_slabs;
+        quic->prewarm_slabs = slab->next_slab;
+#ifdef __linux__
+        if (slab->is_mapped) {
+            munmap(slab->base, slab->size);
+        }
+        else
+#endif
+        {
+            free(slab->base);
+        }
+        free(slab);
+    }
+}
+
+static int picoquic_prewarm_packets(picoquic_quic_t* quic, size_t nb_packets, int use_huge_pages)
+{
+    int ret = 0;
+    size_t stride = PICOQUIC_PREWARM_STRIDE(PICOQUIC_PACKET_ALLOC_SIZE(PICOQUIC_MAX_PACKET_SIZE));
+    size_t nb_new = ((size_t)quic->nb_packets_in_pool < nb_packets) ? nb_packets - (size_t)quic->nb_packets_in_pool : 0;
+    uint8_t* slab = NULL;
+
+    if (quic->tuning.max_packets_in_pool < nb_packets) {
+        quic->tuning.max_packets_in_pool = nb_packets;
+    }
+    if (nb_new > 0 && use_huge_pages && (slab = picoquic_prewarm_slab_alloc(quic, nb_new * stride)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    for (size_t i = 0; ret == 0 && i < nb_new; i++) {
+        picoquic_packet_t* packet = (slab == NULL) ?
+            (picoquic_packet_t*)malloc(PICOQUIC_PACKET_ALLOC_SIZE(PICOQUIC_MAX_PACKET_SIZE)) :
+            (picoquic_packet_t*)(slab + i * stride);
+        if (packet == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(packet, 0, offsetof(struct st_picoquic_packet_t, bytes));
+            packet->bytes_max = PICOQUIC_MAX_PACKET_SIZE;
+            packet->packet_previous = quic->p_first_packet;
+            quic->p_first_packet = packet;
+            quic->nb_packets_in_pool++;
+            quic->nb_packets_allocated++;
+            if (quic->nb_packets_allocated > quic->nb_packets_allocated_max) {
+                quic->nb_packets_allocated_max = quic->nb_packets_allocated;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_prewarm_data_nodes(picoquic_quic_t* quic, size_t nb_data_nodes, int use_huge_pages)
+{
+    int ret = 0;
+    size_t stride = PICOQUIC_PREWARM_STRIDE(PICOQUIC_DATA_NODE_ALLOC_SIZE(PICOQUIC_MAX_PACKET_SIZE));
+    size_t nb_new = ((size_t)quic->nb_data_nodes_in_pool < nb_data_nodes) ? nb_data_nodes - (size_t)quic->nb_data_nodes_in_pool : 0;
+    uint8_t* slab = NULL;
+
+    if (quic->tuning.max_data_nodes_in_pool < nb_data_nodes) {
+        quic->tuning.max_data_nodes_in_pool = nb_data_nodes;
+    }
+    if (nb_new > 0 && use_huge_pages && (slab = picoquic_prewarm_slab_alloc(quic, nb_new * stride)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    for (size_t i = 0; ret == 0 && i < nb_new; i++) {
+        picoquic_stream_data_node_t* stream_data = (slab == NULL) ?
+            (picoquic_stream_data_node_t*)malloc(PICOQUIC_DATA_NODE_ALLOC_SIZE(PICOQUIC_MAX_PACKET_SIZE)) :
+            (picoquic_stream_data_node_t*)(slab + i * stride);
+        if (stream_data == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(stream_data, 0, PICOQUIC_DATA_NODE_ALLOC_SIZE(PICOQUIC_MAX_PACKET_SIZE));
+            stream_data->quic = quic;
+            stream_data->data_max = PICOQUIC_MAX_PACKET_SIZE;
+            stream_data->next_stream_data = quic->p_first_data_node;
+            quic->p_first_data_node = stream_data;
+            quic->nb_data_nodes_in_pool++;
+            quic->nb_data_nodes_allocated++;
+            if (quic->nb_data_nodes_allocated > quic->nb_data_nodes_allocated_max) {
+                quic->nb_data_nodes_allocated_max = quic->nb_data_nodes_allocated;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_prewarm_pools(picoquic_quic_t* quic, size_t nb_packets, size_t nb_data_nodes,
+    size_t nb_connections, int use_huge_pages)
+{
+    int ret = picoquic_prewarm_packets(quic, nb_packets, use_huge_pages);
+
+    if (ret == 0) {
+        ret = picoquic_prewarm_data_nodes(quic, nb_data_nodes, use_huge_pages);
+    }
+
+    if (ret == 0 && nb_connections > 0) {
+        size_t nb_cnxid = nb_connections * quic->default_tp.active_connection_id_limit;
+
+        if ((ret = picoquic_preallocate_objects(quic, picoquic_object_cnx, nb_connections)) == 0 &&
+            (ret = picoquic_preallocate_objects(quic, picoquic_object_path, nb_connections)) == 0 &&
+            (ret = picoquic_preallocate_objects(quic, picoquic_object_tuple, nb_connections)) == 0 &&
+            (ret = picoquic_preallocate_objects(quic, picoquic_object_stream, nb_connections)) == 0 &&
+            (ret = picoquic_preallocate_objects(quic, picoquic_object_local_cnxid, nb_cnxid)) == 0) {
+            ret = picoquic_preallocate_objects(quic, picoquic_object_remote_cnxid, nb_cnxid);
+        }
+    }
+
+    return ret;
+}
@@ -23,6 +23,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+* The pacing engine is a leaky bucket, expressed in nanoseconds. The cost of
+* each packet is computed in picoseconds, and the fraction of a nanosecond that
+* is not charged to the bucket is carried over to the next packet. Without
+* that, the rounding of the packet time to a whole number of nanoseconds
+* causes a systematic error, which becomes significant at rates of several
+* Gbps when the packet time is just a few hundred nanoseconds.
+*
+* If a pacing horizon is set, packets may be released up to that interval
+* before their actual departure time. This is meant for transmission through
+* sockets that accept a departure time per packet, such as SO_TXTIME on Linux.
+* The departure time of the last packet is kept in the pacing context, and
+* can be passed to the socket with the data.
+*/
 
 /* Initialize pacing state to high speed default */
 void picoquic_pacing_init(picoquic_pacing_t* pacing, uint64_t current_time)
@@ -31,15 +45,19 @@ void picoquic_pacing_init(picoquic_pacing_t* pacing, uint64_t current_time)
     pacing->bucket_nanosec = 16;
     pacing->bucket_max = 16;
     pacing->packet_time_nanosec = 1;
+    pacing->packet_time_picosec = 1000;
     pacing->packet_time_microsec = 1;
+    pacing->credit_remainder_picosec = 0;
+    pacing->horizon_nanosec = 0;
+    pacing->last_departure_nanosec = current_time * 1000;
 }
 
 /* Update the leaky bucket used for pacing.
 */
 static void picoquic_update_pacing_bucket(picoquic_pacing_t* pacing, uint64_t current_time)
 {
-    if (pacing->bucket_nanosec < -pacing->packet_time_nanosec) {
-        pacing->bucket_nanosec = -pacing->packet_time_nanosec;
+    if (pacing->bucket_nanosec < -(pacing->packet_time_nanosec + pacing->horizon_nanosec)) {
+        pacing->bucket_nanosec = -(pacing->packet_time_nanosec + pacing->horizon_nanosec);
     }
 
     if (current_time > pacing->evaluation_time) {
@@ -56,7 +74,7 @@ static void picoquic_update_pacing_bucket(picoquic_pacing_t* pacing, uint64_t cu
  */
 int picoquic_is_pacing_blocked(picoquic_pacing_t* pacing)
 {
-    return (pacing->bucket_nanosec < pacing->packet_time_nanosec);
+    return (pacing->bucket_nanosec + pacing->horizon_nanosec < pacing->packet_time_nanosec);
 }
 
 /*
@@ -73,7 +91,7 @@ int picoquic_is_authorized_by_pacing(picoquic_pacing_t * pacing, uint64_t curren
 
     picoquic_update_pacing_bucket(pacing, current_time);
 
-    if (pacing->bucket_nanosec < pacing->packet_time_nanosec) {
+    if (pacing->bucket_nanosec + pacing->horizon_nanosec < pacing->packet_time_nanosec) {
         uint64_t next_pacing_time;
         int64_t bucket_required;
 
@@ -83,14 +101,18 @@ int picoquic_is_authorized_by_pacing(picoquic_pacing_t * pacing, uint64_t curren
             if (bucket_required > 10 * pacing->packet_time_nanosec) {
                 bucket_required = 10 * pacing->packet_time_nanosec;
             }
+            else if (bucket_required < pacing->packet_time_nanosec) {
+                bucket_required = pacing->packet_time_nanosec;
+            }
 
-            bucket_required -= pacing->bucket_nanosec;
+            bucket_required -= pacing->bucket_nanosec + pacing->horizon_nanosec;
         }
         else {
-            bucket_required = pacing->packet_time_nanosec - pacing->bucket_nanosec;
+            bucket_required = pacing->packet_time_nanosec - pacing->bucket_nanosec - pacing->horizon_nanosec;
         }
 
-        next_pacing_time = current_time + 1 + bucket_required / 1000;
+        /* Wake up at the first microsecond at which the credit is sufficient */
+        next_pacing_time = current_time + (bucket_required + 999) / 1000;
         if (next_pacing_time < *next_time) {
             pacing->bandwidth_pause = 0;
             *next_time = next_pacing_time;
@@ -152,15 +174,18 @@ void picoquic_update_pacing_parameters(picoquic_pacing_t * pacing, double pacing
         pacing->rate_max = pacing->rate;
     }
 
-    pacing->packet_time_nanosec = (uint64_t)(packet_time * 1000000000.0);
+    pacing->packet_time_picosec = (uint64_t)(packet_time * 1000000000000.0);
+    pacing->packet_time_nanosec = pacing->packet_time_picosec / 1000;
 
     if (pacing->packet_time_nanosec <= 0) {
         pacing->packet_time_nanosec = 1;
+        pacing->packet_time_picosec = 1000;
         pacing->packet_time_microsec = 1;
     }
     else {
         if ((uint64_t)pacing->packet_time_nanosec > rtt_nanosec) {
             pacing->packet_time_nanosec = rtt_nanosec;
+            pacing->packet_time_picosec = rtt_nanosec * 1000;
         }
         pacing->packet_time_microsec = (pacing->packet_time_nanosec + 999ull) / 1000;
     }
@@ -193,6 +218,7 @@ void picoquic_update_pacing_window(picoquic_pacing_t * pacing, int slow_start, u
         /* Small windows, should only relie on ACK clocking */
         pacing->bucket_max = rtt_nanosec;
         pacing->packet_time_nanosec = 1;
+        pacing->packet_time_picosec = 1000;
         pacing->packet_time_microsec = 1;
 
         if (pacing->bucket_nanosec > pacing->bucket_max) {
@@ -237,17 +263,59 @@ void picoquic_update_pacing_window(picoquic_pacing_t * pacing, int slow_start, u
 */
 void picoquic_update_pacing_data_after_send(picoquic_pacing_t * pacing, size_t length, size_t send_mtu, uint64_t current_time)
 {
-    uint64_t packet_time_nanosec;
+    uint64_t packet_time_picosec;
+    int64_t packet_time_nanosec;
+    uint64_t departure_nanosec;
 
     picoquic_update_pacing_bucket(pacing, current_time);
-    packet_time_nanosec = ((pacing->packet_time_nanosec * (uint64_t)length) + (send_mtu - 1)) / send_mtu;
+    packet_time_picosec = ((pacing->packet_time_picosec * (uint64_t)length) / send_mtu) + pacing->credit_remainder_picosec;
+    packet_time_nanosec = (int64_t)(packet_time_picosec / 1000);
+    pacing->credit_remainder_picosec = packet_time_picosec % 1000;
+
+    /* If the credit is not sufficient, the packet was sent ahead of time,
+     * within the horizon. It should leave when the credit is available. */
+    departure_nanosec = pacing->evaluation_time * 1000;
+    if (pacing->bucket_nanosec < packet_time_nanosec) {
+        departure_nanosec += (uint64_t)(packet_time_nanosec - pacing->bucket_nanosec);
+    }
+    if (departure_nanosec < pacing->last_departure_nanosec) {
+        departure_nanosec = pacing->last_departure_nanosec;
+    }
+    pacing->last_departure_nanosec = departure_nanosec;
     pacing->bucket_nanosec -= packet_time_nanosec;
 }
 
+/* Set the interval during which packets can be released ahead of their departure time
+ */
+void picoquic_set_pacing_data_horizon(picoquic_pacing_t* pacing, uint64_t horizon_microsec)
+{
+    pacing->horizon_nanosec = (int64_t)(horizon_microsec * 1000);
+}
+
+/* Number of full size packets that can be sent immediately, including those
+ * that would be released ahead of time within the horizon.
+ */
+size_t picoquic_get_pacing_data_budget(picoquic_pacing_t* pacing, uint64_t current_time)
+{
+    size_t budget = 0;
+    int64_t credit;
+
+    picoquic_update_pacing_bucket(pacing, current_time);
+    credit = pacing->bucket_nanosec + pacing->horizon_nanosec;
+    if (credit >= pacing->packet_time_nanosec) {
+        budget = (size_t)(credit / pacing->packet_time_nanosec);
+    }
+
+    return budget;
+}
+
 /* Interface functions for compatibility with old implementation */
 void picoquic_update_pacing_after_send(picoquic_path_t* path_x, size_t length, uint64_t current_time)
 {
     picoquic_update_pacing_data_after_send(&path_x->pacing, length, path_x->send_mtu, current_time);
+    if (path_x->cc_group != NULL) {
+        picoquic_cc_manager_after_send(path_x, length, current_time);
+    }
 }
 
 int picoquic_is_sending_authorized_by_pacing(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time, uint64_t* next_time)
@@ -268,3 +336,35 @@ void picoquic_update_pacing_data(picoquic_cnx_t* cnx, picoquic_path_t* path_x, i
     picoquic_update_pacing_window(&path_x->pacing, slow_start, path_x->cwin, path_x->send_mtu, path_x->smoothed_rtt,
         path_x);
 }
+
+/* Pacing API for applications that control the departure time of packets.
+ */
+int picoquic_get_next_departure_time(picoquic_cnx_t* cnx, uint64_t unique_path_id, uint64_t* departure_nanosec)
+{
+    int ret = -1;
+    int path_id = picoquic_get_path_id_from_unique(cnx, unique_path_id);
+
+    if (path_id >= 0) {
+        *departure_nanosec = cnx->path[path_id]->pacing.last_departure_nanosec;
+        ret = 0;
+    }
+
+    return ret;
+}
+
+size_t picoquic_get_pacing_burst_budget(picoquic_cnx_t* cnx, uint64_t unique_path_id, uint64_t current_time)
+{
+    size_t budget = 0;
+    int path_id = picoquic_get_path_id_from_unique(cnx, unique_path_id);
+
+    if (path_id >= 0) {
+        budget = picoquic_get_pacing_data_budget(&cnx->path[path_id]->pacing, current_time);
+    }
+
+    return budget;
+}
+
+uint64_t picoquic_get_departure_time_nanosec(picoquic_cnx_t* cnx)
+{
+    return cnx->departure_time_nanosec;
+}
@@ -31,6 +31,7 @@
 #include "picoquic_binlog.h"
 #include "picoquic_unified_log.h"
 #include "tls_api.h"
+#include "picoquic_probes.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -116,22 +117,42 @@ int picoquic_screen_initial_packet(
         /* Cannot create a client connection now, send immediate close. */
         ret = PICOQUIC_ERROR_SERVER_BUSY;
     }
+    else if (!picoquic_admission_is_replay(quic) && picoquic_initial_rate_check(quic, addr_from, current_time) != 0) {
+        /* Too many Initial packets from this prefix, drop before any processing */
+        ret = PICOQUIC_ERROR_INITIAL_RATE_LIMITED;
+    }
     else {
         /* This code assumes that *pcnx is always null when screen initial is called. */
-        /* Verify the AEAD checkum */
-        void* aead_ctx = NULL;
-        void* pn_dec_ctx = NULL;
+        /* Verify the AEAD checkum. The keys are cached, and handed over to the
+         * connection context if one is created. */
+        picoquic_crypto_context_t* initial_keys = NULL;
         uint8_t decrypted_bytes[PICOQUIC_MAX_PACKET_SIZE];
         picoquic_packet_header dph = *ph;
+        int is_new_token = 0;
+        int has_bad_token = 0;
+        picoquic_connection_id_t original_cnxid = { 0 };
+
+        if (ph->token_length > 0) {
+            /* Stateless check of the token before deriving the Initial keys. The packet
+             * number is not yet known and reuse is not checked, both are verified
+             * after decryption. Bad retry tokens are dropped right away. */
+            if (picoquic_verify_retry_token(quic, addr_from, current_time,
+                &is_new_token, &original_cnxid, &ph->dest_cnx_id, UINT32_MAX,
+                ph->token_bytes, ph->token_length, 0) != 0) {
+                has_bad_token = 1;
+            }
+        }
 
-        if (picoquic_get_initial_aead_context(quic, ph->version_index, &ph->dest_cnx_id,
-            0 /* is_client=0 */, 0 /* is_enc = 0 */, &aead_ctx, &pn_dec_ctx) == 0) {
+        if (has_bad_token && !is_new_token) {
+            ret = PICOQUIC_ERROR_INVALID_TOKEN;
+        }
+        else if ((initial_keys = picoquic_initial_key_cache_get(quic, ph->version_index, &ph->dest_cnx_id)) != NULL) {
             ret = picoquic_remove_header_protection_inner((uint8_t *)bytes, ph->offset + ph->payload_length,
-                decrypted_bytes, &dph, pn_dec_ctx, 0 /* is_loss_bit_enabled_incoming */, 0 /* sack_list_last*/);
+                decrypted_bytes, &dph, initial_keys->pn_dec, 0 /* is_loss_bit_enabled_incoming */, 0 /* sack_list_last*/);
             if (ret == 0) {
                 size_t decrypted_length = picoquic_aead_decrypt_generic(decrypted_bytes + dph.offset,
                     bytes + dph.offset, dph.payload_length, dph.pn64, decrypted_bytes, dph.offset, 
-                    aead_ctx);
+                    initial_keys->aead_decrypt);
                 if (decrypted_length >= dph.payload_length) {
                     ret = PICOQUIC_ERROR_AEAD_CHECK;
                 }
@@ -141,23 +162,11 @@ int picoquic_screen_initial_packet(
             ret = PICOQUIC_ERROR_MEMORY;
         }
 
-        if (aead_ctx != NULL) {
-            /* Free the AEAD CTX */
-            picoquic_aead_free(aead_ctx);
-        }
-
-        if (pn_dec_ctx != NULL) {
-            /* Free the PN encryption context */
-            picoquic_cipher_free(pn_dec_ctx);
-        }
-
         if (ret == 0) {
             int is_address_blocked = !quic->is_port_blocking_disabled && picoquic_check_addr_blocked(addr_from);
-            int is_new_token = 0;
             int has_good_token = 0;
-            int has_bad_token = 0;
-            picoquic_connection_id_t original_cnxid = { 0 };
-            if (ph->token_length > 0) {
+
+            if (ph->token_length > 0 && !has_bad_token) {
                 /* If a token is present, verify it. */
                 if (picoquic_verify_retry_token(quic, addr_from, current_time,
                     &is_new_token, &original_cnxid, &ph->dest_cnx_id, (uint32_t)dph.pn64,
@@ -177,6 +186,9 @@ int picoquic_screen_initial_packet(
                 /* tokens are required before accepting new connections, so ask to queue a retry packet. */
                 ret = PICOQUIC_ERROR_RETRY_NEEDED;
             }
+            else if ((ret = picoquic_admission_check(quic, has_good_token, current_time)) != 0) {
+                /* Over the handshake budget, the caller queues the packet */
+            }
             else {
                 /* All clear */
                 /* Check: what do do with odcid? */
@@ -407,7 +419,8 @@ int picoquic_parse_short_packet_header(
         if (*pcnx == NULL)
         {
             if (quic->local_cnxid_length > 0) {
-                *pcnx = picoquic_cnx_by_id(quic, ph->dest_cnx_id, &ph->l_cid);
+                *pcnx = (receiving) ? picoquic_cnx_by_id_cached(quic, ph->dest_cnx_id, &ph->l_cid) :
+                    picoquic_cnx_by_id(quic, ph->dest_cnx_id, &ph->l_cid);
             }
             else {
                 *pcnx = picoquic_cnx_by_net(quic, addr_from);
@@ -514,14 +527,16 @@ uint64_t picoquic_get_packet_number64(uint64_t highest, uint64_t mask, uint32_t
 }
 
 /*
- * Remove header protection 
+ * Remove header protection. If the mask was already computed as part of
+ * a batch, it is passed as "precomputed_mask".
  */
-int picoquic_remove_header_protection_inner(
+static int picoquic_remove_header_protection_masked(
     uint8_t* bytes,
     size_t length,
     uint8_t* decrypted_bytes,
     picoquic_packet_header* ph,
     void * pn_enc,
+    const uint8_t* precomputed_mask,
     unsigned int is_loss_bit_enabled_incoming,
     uint64_t sack_list_last)
 {
@@ -553,8 +568,15 @@ int picoquic_remove_header_protection_inner(
             uint8_t pn_l;
             uint32_t pn_val = 0;
 
-            memcpy(decrypted_bytes, bytes, ph->pn_offset);
-            picoquic_pn_encrypt(pn_enc, bytes + sample_offset, mask_bytes, mask_bytes, mask_length);
+            if (decrypted_bytes != bytes) {
+                memcpy(decrypted_bytes, bytes, ph->pn_offset);
+            }
+            if (precomputed_mask != NULL) {
+                memcpy(mask_bytes, precomputed_mask, mask_length);
+            }
+            else {
+                picoquic_pn_encrypt(pn_enc, bytes + sample_offset, mask_bytes, mask_bytes, mask_length);
+            }
             /* Decode the first byte */
             first_byte ^= (mask_bytes[0] & first_mask);
             pn_l = (first_byte & 3) + 1;
@@ -604,6 +626,108 @@ int picoquic_remove_header_protection_inner(
     return ret;
 }
 
+int picoquic_remove_header_protection_inner(
+    uint8_t* bytes,
+    size_t length,
+    uint8_t* decrypted_bytes,
+    picoquic_packet_header* ph,
+    void * pn_enc,
+    unsigned int is_loss_bit_enabled_incoming,
+    uint64_t sack_list_last)
+{
+    return picoquic_remove_header_protection_masked(bytes, length, decrypted_bytes, ph, pn_enc, NULL,
+        is_loss_bit_enabled_incoming, sack_list_last);
+}
+
+/*
+ * Batch computation of header protection masks.
+ *
+ * When a GRO batch carries several short header packets for the same connection,
+ * the masks are computed in a single cipher call before the packets are processed,
+ * and then consumed in packet order by picoquic_remove_header_protection().
+ * The masks are tied to the receive buffer, and are cleared at the end of the
+ * receive batch.
+ */
+void picoquic_prepare_header_masks(picoquic_quic_t* quic, const uint8_t* bytes, size_t length, size_t segment_size)
+{
+    picoquic_hp_mask_batch_t* batch = quic->hp_mask_batch;
+
+    picoquic_clear_header_masks(quic);
+
+    if (segment_size > 0 && length > segment_size && quic->local_cnxid_length > 0) {
+        size_t pn_offset = 1 + (size_t)quic->local_cnxid_length;
+        const uint8_t* samples[PICOQUIC_HP_MASK_BATCH_MAX];
+        picoquic_cnx_t* cnx = NULL;
+        size_t nb_masks = 0;
+
+        if (batch == NULL) {
+            batch = (picoquic_hp_mask_batch_t*)malloc(sizeof(picoquic_hp_mask_batch_t));
+            if (batch != NULL) {
+                memset(batch, 0, sizeof(picoquic_hp_mask_batch_t));
+                quic->hp_mask_batch = batch;
+            }
+        }
+
+        for (size_t offset = 0; batch != NULL && offset < length && nb_masks < PICOQUIC_HP_MASK_BATCH_MAX;
+            offset += segment_size) {
+            const uint8_t* packet = bytes + offset;
+            size_t packet_length = (length - offset < segment_size) ? length - offset : segment_size;
+            picoquic_connection_id_t cnx_id;
+            picoquic_cnx_t* packet_cnx;
+
+            if ((packet[0] & 0x80) != 0 || packet_length < pn_offset + 4 + 16 ||
+                picoquic_parse_connection_id(packet + 1, quic->local_cnxid_length, &cnx_id) == 0) {
+                /* Not a short header packet with a sample, the header will be processed as usual */
+                continue;
+            }
+            packet_cnx = picoquic_cnx_by_id(quic, cnx_id, NULL);
+            if (packet_cnx == NULL || (cnx != NULL && packet_cnx != cnx) ||
+                packet_cnx->crypto_context[picoquic_epoch_1rtt].pn_dec == NULL) {
+                /* Only batch the packets of a single connection */
+                break;
+            }
+            cnx = packet_cnx;
+            batch->packet[nb_masks] = packet;
+            samples[nb_masks] = packet + pn_offset + 4;
+            nb_masks++;
+        }
+
+        if (nb_masks > 1) {
+            picoquic_pn_mask_batch(cnx->crypto_context[picoquic_epoch_1rtt].pn_dec,
+                cnx->crypto_context[picoquic_epoch_1rtt].pn_dec_ecb, samples, batch->mask, nb_masks);
+            batch->cnx = cnx;
+            batch->nb_masks = nb_masks;
+        }
+    }
+}
+
+void picoquic_clear_header_masks(picoquic_quic_t* quic)
+{
+    if (quic->hp_mask_batch != NULL) {
+        quic->hp_mask_batch->cnx = NULL;
+        quic->hp_mask_batch->nb_masks = 0;
+        quic->hp_mask_batch->next_mask = 0;
+    }
+}
+
+static const uint8_t* picoquic_find_header_mask(picoquic_cnx_t* cnx, const uint8_t* bytes, picoquic_packet_header* ph)
+{
+    const uint8_t* mask = NULL;
+    picoquic_hp_mask_batch_t* batch = cnx->quic->hp_mask_batch;
+
+    if (batch != NULL && batch->cnx == cnx && ph->epoch == picoquic_epoch_1rtt) {
+        for (size_t i = batch->next_mask; i < batch->nb_masks; i++) {
+            if (batch->packet[i] == bytes) {
+                mask = batch->mask + 16 * i;
+                batch->next_mask = i + 1;
+                break;
+            }
+        }
+    }
+
+    return mask;
+}
+
 int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
     uint8_t* bytes,
     uint8_t * decrypted_bytes,
@@ -614,8 +738,9 @@ int picoquic_remove_header_protection(picoquic_cnx_t* cnx,
     void * pn_enc = cnx->crypto_context[ph->epoch].pn_dec;
 
     picoquic_sack_list_t* sack_list = picoquic_sack_list_from_cnx_context(cnx, ph->pc, ph->l_cid);
-    ret = picoquic_remove_header_protection_inner(bytes, length, decrypted_bytes, ph,
-        pn_enc, cnx->is_loss_bit_enabled_incoming, picoquic_sack_list_last(sack_list));
+    ret = picoquic_remove_header_protection_masked(bytes, length, decrypted_bytes, ph,
+        pn_enc, picoquic_find_header_mask(cnx, bytes, ph),
+        cnx->is_loss_bit_enabled_incoming, picoquic_sack_list_last(sack_list));
 
     return ret;
 }
@@ -650,7 +775,7 @@ size_t picoquic_remove_packet_protection(picoquic_cnx_t* cnx,
         /* Manage key rotation */
         if (ph->key_phase == cnx->key_phase_dec) {
             /* AEAD Decrypt */
-            if (cnx->is_multipath_enabled && ph->ptype == picoquic_packet_1rtt_protected) {
+            if (PICOQUIC_CNX_IS_MULTIPATH(cnx) && ph->ptype == picoquic_packet_1rtt_protected) {
                 decoded = picoquic_aead_decrypt_mp(decoded_bytes + ph->offset,
                     bytes + ph->offset,
                     ph->payload_length, 
@@ -674,7 +799,7 @@ size_t picoquic_remove_packet_protection(picoquic_cnx_t* cnx,
                 need_integrity_check = 0;
             }
             else if (cnx->crypto_context_old.aead_decrypt != NULL) {
-                if (cnx->is_multipath_enabled) {
+                if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                     decoded = picoquic_aead_decrypt_mp(decoded_bytes + ph->offset, bytes + ph->offset, ph->payload_length,
                         ph->l_cid->path_id, ph->pn64, decoded_bytes, ph->offset, cnx->crypto_context_old.aead_decrypt);
                 }
@@ -699,7 +824,7 @@ size_t picoquic_remove_packet_protection(picoquic_cnx_t* cnx,
             }
             /* if decoding succeeds, the rotation should be validated */
             if (ret == 0 && cnx->crypto_context_new.aead_decrypt != NULL) {
-                if (cnx->is_multipath_enabled) {
+                if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                     decoded = picoquic_aead_decrypt_mp(decoded_bytes + ph->offset, bytes + ph->offset, ph->payload_length,
                         ph->l_cid->path_id, ph->pn64, decoded_bytes, ph->offset, cnx->crypto_context_new.aead_decrypt);
 
@@ -711,7 +836,7 @@ size_t picoquic_remove_packet_protection(picoquic_cnx_t* cnx,
                 if (decoded <= ph->payload_length) {
                     /* Rotation only if the packet was correctly decrypted with the new key */
                     cnx->crypto_rotation_time_guard = current_time + cnx->path[0]->retransmit_timer;
-                    if (cnx->is_multipath_enabled) {
+                    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
                         for (int i=0; i < cnx->nb_paths; i++){
                             cnx->path[i]->ack_ctx.crypto_rotation_sequence = UINT64_MAX;
                         }
@@ -757,14 +882,17 @@ size_t picoquic_remove_packet_protection(picoquic_cnx_t* cnx,
     return decoded;
 }
 
-int picoquic_parse_header_and_decrypt(
+/* Parse the header and decrypt the packet into decrypted_bytes. If that is
+ * the same pointer as bytes, the packet is decrypted in place.
+ */
+static int picoquic_parse_header_and_decrypt_ex(
     picoquic_quic_t* quic,
     const uint8_t* bytes,
     size_t length,
     size_t packet_length,
     const struct sockaddr* addr_from,
     uint64_t current_time,
-    picoquic_stream_data_node_t* decrypted_data,
+    uint8_t* decrypted_bytes,
     picoquic_packet_header* ph,
     picoquic_cnx_t** pcnx,
     size_t * consumed,
@@ -812,12 +940,12 @@ int picoquic_parse_header_and_decrypt(
 
                     if (ret == 0) {
                         /* Remove header protection at this point -- values of bytes will not change */
-                        ret = picoquic_remove_header_protection(*pcnx, (uint8_t*)bytes, decrypted_data->data, ph);
+                        ret = picoquic_remove_header_protection(*pcnx, (uint8_t*)bytes, decrypted_bytes, ph);
                     }
 
                     if (ret == 0) {
                         decoded_length = picoquic_remove_packet_protection(*pcnx, (uint8_t*)bytes,
-                            decrypted_data->data, ph, current_time, &already_received);
+                            decrypted_bytes, ph, current_time, &already_received);
                     }
                     else {
                         decoded_length = ph->payload_length + 1;
@@ -855,7 +983,8 @@ int picoquic_parse_header_and_decrypt(
                      * We test the address + putative reset secret pair against the hash table
                      * of registered secrets. If there is a match, the corresponding connection is
                      * found and the packet is marked as Stateless Reset */
-                    if (length >= PICOQUIC_RESET_PACKET_MIN_SIZE) {
+                    if (length >= PICOQUIC_RESET_PACKET_MIN_SIZE &&
+                        picoquic_reset_filter_check(quic, bytes + length - PICOQUIC_RESET_SECRET_SIZE)) {
                         *pcnx = picoquic_cnx_by_secret(quic, bytes + length - PICOQUIC_RESET_SECRET_SIZE, addr_from);
                         if (*pcnx != NULL) {
                             ret = PICOQUIC_ERROR_STATELESS_RESET;
@@ -867,7 +996,7 @@ int picoquic_parse_header_and_decrypt(
         }
         else {
             /* Clear text packet. Copy content to decrypted data */
-            memmove(decrypted_data->data, bytes, length);
+            memmove(decrypted_bytes, bytes, length);
             *consumed = length;
         }
     }
@@ -875,6 +1004,23 @@ int picoquic_parse_header_and_decrypt(
     return ret;
 }
 
+int picoquic_parse_header_and_decrypt(
+    picoquic_quic_t* quic,
+    const uint8_t* bytes,
+    size_t length,
+    size_t packet_length,
+    const struct sockaddr* addr_from,
+    uint64_t current_time,
+    picoquic_stream_data_node_t* decrypted_data,
+    picoquic_packet_header* ph,
+    picoquic_cnx_t** pcnx,
+    size_t * consumed,
+    int * new_ctx_created)
+{
+    return picoquic_parse_header_and_decrypt_ex(quic, bytes, length, packet_length, addr_from, current_time,
+        decrypted_data->data, ph, pcnx, consumed, new_ctx_created);
+}
+
 /*
  * Processing of a version renegotiation packet.
  *
@@ -1020,11 +1166,9 @@ void picoquic_prepare_version_negotiation(
             memcpy(bytes + byte_index, dcid, dcid_length);
             byte_index += dcid_length;
 
-            /* Set the payload to the list of versions */
-            for (size_t i = 0; i < picoquic_nb_supported_versions; i++) {
-                picoformat_32(bytes + byte_index, picoquic_supported_versions[i].version);
-                byte_index += 4;
-            }
+            /* Set the payload to the list of versions, encoded at context creation */
+            memcpy(bytes + byte_index, quic->vn_version_list, quic->vn_version_list_length);
+            byte_index += quic->vn_version_list_length;
             /* Add random reserved value as grease, but be careful to not match proposed version */
             do {
                 rand_vn = (((uint32_t)picoquic_public_random_64()) & 0xF0F0F0F0) | 0x0A0A0A0A;
@@ -1222,8 +1366,7 @@ int picoquic_queue_busy_packet(
     int ret = 0;
     picoquic_connection_id_t s_cid = { 0 };
     picoquic_stateless_packet_t* sp = picoquic_create_stateless_packet(quic);
-    void* aead_ctx = NULL;
-    void* pn_enc_ctx = NULL;
+    picoquic_crypto_context_t* initial_keys = NULL;
 
     if (sp != NULL) {
         uint8_t* bytes = sp->bytes;
@@ -1253,18 +1396,17 @@ int picoquic_queue_busy_packet(
             &pn_offset,
             &pn_length);
 
-        /* Apply AEAD */
-        if (picoquic_get_initial_aead_context(quic, ph->version_index, &ph->dest_cnx_id,
-            0 /* is_client=0 */, 1 /* is_enc = 1 */, &aead_ctx, &pn_enc_ctx) == 0) {
+        /* Apply AEAD, using the keys cached when the Initial was screened */
+        if ((initial_keys = picoquic_initial_key_cache_get(quic, ph->version_index, &ph->dest_cnx_id)) != NULL) {
             /* Make sure that the payload length is encoded in the header */
             /* Using encryption, the "payload" length also includes the encrypted packet length */
             picoquic_update_payload_length(bytes, pn_offset, header_length - pn_length,
-                header_length + sizeof(payload) + picoquic_aead_get_checksum_length(aead_ctx));
+                header_length + sizeof(payload) + picoquic_aead_get_checksum_length(initial_keys->aead_encrypt));
             /* Encrypt packet payload */
             payload_length = picoquic_aead_encrypt_generic(bytes + header_length,
-                payload, sizeof(payload), 0, bytes, header_length, aead_ctx);
+                payload, sizeof(payload), 0, bytes, header_length, initial_keys->aead_encrypt);
             /* protect the PN */
-            picoquic_protect_packet_header(bytes, pn_offset, 0x0F, pn_enc_ctx);
+            picoquic_protect_packet_header(bytes, pn_offset, 0x0F, initial_keys->pn_enc);
             /* Fill up control fields */
             sp->length = byte_index + payload_length;
             sp->ptype = picoquic_packet_initial;
@@ -1275,16 +1417,6 @@ int picoquic_queue_busy_packet(
             /* Queue packet */
             picoquic_queue_stateless_packet(quic, sp);
         }
-
-        if (aead_ctx != NULL) {
-            /* Free the AEAD CTX */
-            picoquic_aead_free(aead_ctx);
-        }
-
-        if (pn_enc_ctx != NULL) {
-            /* Free the PN encryption context */
-            picoquic_cipher_free(pn_enc_ctx);
-        }
     }
     return ret;
 }
@@ -1303,7 +1435,7 @@ void picoquic_queue_immediate_close(picoquic_cnx_t* cnx, uint64_t current_time)
             picoquic_queue_stateless_packet(cnx->quic, sp);
         }
         else {
-            picoquic_delete_stateless_packet(sp);
+            picoquic_delete_stateless_packet(cnx->quic, sp);
         }
     }
 }
@@ -1860,7 +1992,7 @@ void picoquic_ecn_accounting(picoquic_cnx_t* cnx,
 {
     picoquic_ack_context_t* ack_ctx = &cnx->ack_ctx[pc];
     
-    if (pc == picoquic_packet_context_application && cnx->is_multipath_enabled) {
+    if (pc == picoquic_packet_context_application && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         ack_ctx = picoquic_ack_ctx_from_cnx_context(cnx, pc, l_cid);
     }
 
@@ -1954,6 +2086,12 @@ int picoquic_incoming_1rtt(
                 ph->epoch, addr_from, addr_to, ph->pn64,
                 path_is_not_allocated, current_time);
 
+            if (ret == 0 && cnx->is_fec_negotiated && cnx->local_parameters.enable_fec) {
+                /* Keep the payload for FEC, and rebuild lost packets if possible */
+                ret = picoquic_fec_incoming_packet(cnx, path_x, ph, bytes + ph->offset,
+                    addr_from, addr_to, current_time);
+            }
+
             if (ret == 0) {
                 /* Compute receive bandwidth */
                 path_x->received += (uint64_t)ph->offset + ph->payload_length +
@@ -2018,8 +2156,9 @@ int  picoquic_incoming_not_decrypted(
 
             if (length <= PICOQUIC_MAX_PACKET_SIZE &&
                 ((ph->ptype == picoquic_packet_handshake && cnx->client_mode) || ph->ptype == picoquic_packet_1rtt_protected)) {
-                /* stash a copy of the incoming message for processing once the keys are available */
-                picoquic_stateless_packet_t* packet = picoquic_create_stateless_packet(cnx->quic);
+                /* stash a copy of the incoming message for processing once the keys are available.
+                 * The copy is kept by the connection, so it is not taken from the stateless ring. */
+                picoquic_stateless_packet_t* packet = (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
 
                 if (packet != NULL) {
                     packet->length = length;
@@ -2045,6 +2184,39 @@ int  picoquic_incoming_not_decrypted(
 * Processing of the packet that was just received from the network.
 */
 
+/* Inside a receive batch, the connections are only reinserted in the wake
+ * list once, at the end of the batch, instead of after each packet. */
+static void picoquic_reinsert_after_receive(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    if (!cnx->quic->is_receive_batch_open) {
+        picoquic_reinsert_by_wake_time(cnx->quic, cnx, current_time);
+    }
+    else {
+        cnx->wake_batch_time = current_time;
+        if (!cnx->is_wake_batch_queued) {
+            cnx->wake_batch_next = cnx->quic->wake_batch_first;
+            cnx->quic->wake_batch_first = cnx;
+            cnx->is_wake_batch_queued = 1;
+        }
+    }
+}
+
+void picoquic_wake_batch_forget_cnx(picoquic_cnx_t* cnx)
+{
+    if (cnx->is_wake_batch_queued) {
+        picoquic_cnx_t** pprevious = &cnx->quic->wake_batch_first;
+
+        while (*pprevious != NULL && *pprevious != cnx) {
+            pprevious = &(*pprevious)->wake_batch_next;
+        }
+        if (*pprevious != NULL) {
+            *pprevious = cnx->wake_batch_next;
+        }
+        cnx->wake_batch_next = NULL;
+        cnx->is_wake_batch_queued = 0;
+    }
+}
+
 int picoquic_incoming_segment(
     picoquic_quic_t* quic,
     uint8_t* raw_bytes,
@@ -2069,17 +2241,34 @@ int picoquic_incoming_segment(
     int path_id = -1;
     int path_is_not_allocated = 0;
     uint8_t* bytes = NULL;
-    picoquic_stream_data_node_t* decrypted_data = picoquic_stream_data_node_alloc(quic);
+    picoquic_stream_data_node_t* decrypted_data = NULL;
 
-    if (decrypted_data == NULL) {
+    if (quic->is_in_place_decryption_enabled && (raw_bytes[0] & 0x80) == 0) {
+        /* Fast path for short header packets: decrypt in the receive buffer,
+         * without allocating a packet buffer. Stream data that has to be
+         * kept is copied by the frame decoder. */
+        bytes = raw_bytes;
+        quic->nb_in_place_decryptions++;
+    }
+    else if (length > PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
+        /* Larger than any packet we could have sent or advertised. */
+        *consumed = length;
+        return PICOQUIC_ERROR_PACKET_TOO_LONG;
+    }
+    else if ((decrypted_data = picoquic_stream_data_node_alloc_ex(quic, length)) == NULL) {
         return -1;
     }
+    else {
+        bytes = decrypted_data->data;
+    }
     /* Parse the header and decrypt the segment */
-    ret = picoquic_parse_header_and_decrypt(quic, raw_bytes, length, packet_length, addr_from,
-        current_time, decrypted_data, &ph, &cnx, consumed, &new_context_created);
-    bytes = decrypted_data->data;
+    ret = picoquic_parse_header_and_decrypt_ex(quic, raw_bytes, length, packet_length, addr_from,
+        current_time, bytes, &ph, &cnx, consumed, &new_context_created);
 
     if (ret == 0 && cnx != NULL) {
+        if (cnx->is_hibernating) {
+            picoquic_rehydrate_cnx(cnx);
+        }
         if (ph.ptype == picoquic_packet_1rtt_protected) {
             /* Find the arrival path and update its state */
             ret = picoquic_find_incoming_path(cnx, &ph, addr_from, addr_to, if_index_to, current_time, &path_id, &path_is_not_allocated);
@@ -2166,6 +2355,9 @@ int picoquic_incoming_segment(
                 picoquic_queue_retry_packet(quic, addr_from, addr_to, if_index_to, &ph, current_time);
             }
         }
+    } else if (ret == PICOQUIC_ERROR_INITIAL_QUEUED) {
+        /* Over the handshake budget, keep the whole datagram for later */
+        picoquic_admission_queue(quic, raw_bytes, length, addr_from, addr_to, if_index_to, received_ecn, current_time);
     } else if (ret == PICOQUIC_ERROR_SERVER_BUSY) {
         /* Incoming packet could not be processed, need to send a Retry. */
         if (packet_length >= PICOQUIC_ENFORCED_INITIAL_MTU){
@@ -2177,7 +2369,9 @@ int picoquic_incoming_segment(
         if (cnx == NULL) {
             /* Unexpected packet. Reject, drop and log. */
             if (!picoquic_is_connection_id_null(&ph.dest_cnx_id) &&
-                (quic->is_port_blocking_disabled || !picoquic_check_addr_blocked(addr_from))) {
+                (quic->is_port_blocking_disabled || !picoquic_check_addr_blocked(addr_from)) &&
+                (quic->tombstones == NULL ||
+                    !picoquic_tombstone_incoming(quic, &ph.dest_cnx_id, length, addr_from, addr_to, if_index_to, current_time))) {
                 picoquic_process_unexpected_cnxid(quic, length, addr_from, addr_to, if_index_to, &ph, current_time);
             }
             ret = PICOQUIC_ERROR_DETECTED;
@@ -2301,6 +2495,9 @@ int picoquic_incoming_segment(
         if (cnx != NULL && cnx->cnx_state != picoquic_state_disconnected &&
             ph.ptype != picoquic_packet_version_negotiation) {
             cnx->nb_packets_received++;
+            if (quic->metrics != NULL) {
+                quic->metrics->live.nb_packets_received++;
+            }
             cnx->latest_receive_time = current_time;
             /* Mark the sequence number as received */
             ret = picoquic_record_pn_received(cnx, ph.pc, ph.l_cid, ph.pn64, receive_time);
@@ -2308,7 +2505,7 @@ int picoquic_incoming_segment(
             picoquic_ecn_accounting(cnx, received_ecn, ph.pc, ph.l_cid);
         }
         if (cnx != NULL) {
-            picoquic_reinsert_by_wake_time(cnx->quic, cnx, current_time);
+            picoquic_reinsert_after_receive(cnx, current_time);
         }
     } else if (ret == PICOQUIC_ERROR_AEAD_CHECK || ret == PICOQUIC_ERROR_INITIAL_TOO_SHORT ||
         ret == PICOQUIC_ERROR_PACKET_WRONG_VERSION ||
@@ -2323,9 +2520,11 @@ int picoquic_incoming_segment(
         ret == PICOQUIC_ERROR_VERSION_NOT_SUPPORTED ||
         ret == PICOQUIC_ERROR_PACKET_TOO_LONG ||
         ret == PICOQUIC_ERROR_DUPLICATE ||
-        ret == PICOQUIC_ERROR_AEAD_NOT_READY) {
+        ret == PICOQUIC_ERROR_AEAD_NOT_READY ||
+        ret == PICOQUIC_ERROR_INITIAL_RATE_LIMITED) {
         /* Bad packets are dropped silently */
         if (ret == PICOQUIC_ERROR_AEAD_CHECK ||
+            ret == PICOQUIC_ERROR_INITIAL_RATE_LIMITED ||
             ret == PICOQUIC_ERROR_PACKET_WRONG_VERSION ||
             ret == PICOQUIC_ERROR_AEAD_NOT_READY ||
             ret == PICOQUIC_ERROR_PACKET_TOO_LONG ||
@@ -2338,7 +2537,7 @@ int picoquic_incoming_segment(
             ret = -1;
         }
         if (cnx != NULL) {
-            picoquic_reinsert_by_wake_time(cnx->quic, cnx, current_time);
+            picoquic_reinsert_after_receive(cnx, current_time);
         }
     } else if (ret == 1) {
         /* wonder what happened ! */
@@ -2356,10 +2555,57 @@ int picoquic_incoming_segment(
         picoquic_stream_data_node_recycle(decrypted_data);
     }
 
+    PICOQUIC_PROBE5(incoming_segment, cnx, (int)ph.ptype, ph.pn64, *consumed, ret);
+
     return ret;
 }
 
-int picoquic_incoming_packet_ex(
+void picoquic_receive_batch_start(picoquic_quic_t* quic)
+{
+    quic->is_receive_batch_open = 1;
+}
+
+void picoquic_receive_batch_end(picoquic_quic_t* quic)
+{
+    quic->is_receive_batch_open = 0;
+    picoquic_clear_header_masks(quic);
+
+    while (quic->ack_batch_first != NULL) {
+        picoquic_cnx_t* cnx = quic->ack_batch_first;
+
+        quic->ack_batch_first = cnx->ack_batch_next;
+        cnx->ack_batch_next = NULL;
+        cnx->is_ack_batch_queued = 0;
+        picoquic_ack_batch_flush(cnx);
+    }
+
+    /* Stream data and datagrams received in the batch, if coalesced delivery is enabled */
+    while (quic->delivery_batch_first != NULL) {
+        picoquic_cnx_t* cnx = quic->delivery_batch_first;
+
+        quic->delivery_batch_first = cnx->delivery_batch_next;
+        cnx->delivery_batch_next = NULL;
+        cnx->is_delivery_batch_queued = 0;
+        picoquic_delivery_batch_flush(cnx);
+    }
+
+    /* The ACKs are processed first, so the wake time accounts for them */
+    while (quic->wake_batch_first != NULL) {
+        picoquic_cnx_t* cnx = quic->wake_batch_first;
+
+        quic->wake_batch_first = cnx->wake_batch_next;
+        cnx->wake_batch_next = NULL;
+        cnx->is_wake_batch_queued = 0;
+        picoquic_reinsert_by_wake_time(quic, cnx, cnx->wake_batch_time);
+    }
+
+    /* Initial packets deferred during the batch, served in priority order */
+    if (quic->admission != NULL && quic->admission->nb_queued > 0) {
+        (void)picoquic_admission_process(quic, picoquic_get_quic_time(quic));
+    }
+}
+
+int picoquic_incoming_packet_ts(
     picoquic_quic_t* quic,
     uint8_t* bytes,
     size_t packet_length,
@@ -2368,11 +2614,31 @@ int picoquic_incoming_packet_ex(
     int if_index_to,
     unsigned char received_ecn,
     picoquic_cnx_t** first_cnx,
+    uint64_t receive_time,
     uint64_t current_time)
 {
     size_t consumed_index = 0;
     int ret = 0;
     picoquic_connection_id_t previous_destid = picoquic_null_connection_id;
+    int is_batch_owner = !quic->is_receive_batch_open;
+    picoquic_cpu_mark_t cpu_mark;
+
+    picoquic_cpu_mark(quic, &cpu_mark);
+    picoquic_cache_quic_time(quic, current_time);
+
+    if (receive_time != 0 && receive_time < current_time) {
+        current_time = receive_time;
+    }
+
+    if (quic->metrics != NULL) {
+        quic->metrics->live.nb_datagrams_received++;
+        quic->metrics->live.nb_bytes_received += packet_length;
+    }
+
+    if (is_batch_owner) {
+        /* Coalesced packets form a batch of their own */
+        picoquic_receive_batch_start(quic);
+    }
 
     while (consumed_index < packet_length) {
         size_t consumed = 0;
@@ -2394,10 +2660,79 @@ int picoquic_incoming_packet_ex(
         }
     }
 
+    if (is_batch_owner) {
+        picoquic_receive_batch_end(quic);
+    }
+
     if (*first_cnx != NULL && packet_length > (*first_cnx)->max_mtu_received) {
         (*first_cnx)->max_mtu_received = packet_length;
     }
 
+    if (*first_cnx != NULL) {
+        /* Coalesced packets normally belong to the same connection */
+        (*first_cnx)->cpu_ticks_receive += picoquic_cpu_elapsed(quic, &cpu_mark);
+    }
+
+    return ret;
+}
+
+int picoquic_incoming_packet_ex(
+    picoquic_quic_t* quic,
+    uint8_t* bytes,
+    size_t packet_length,
+    struct sockaddr* addr_from,
+    struct sockaddr* addr_to,
+    int if_index_to,
+    unsigned char received_ecn,
+    picoquic_cnx_t** first_cnx,
+    uint64_t current_time)
+{
+    return picoquic_incoming_packet_ts(quic, bytes, packet_length, addr_from, addr_to,
+        if_index_to, received_ecn, first_cnx, current_time, current_time);
+}
+
+int picoquic_incoming_packets(
+    picoquic_quic_t* quic,
+    const picoquic_incoming_datagram_t* datagrams,
+    size_t nb_datagrams,
+    picoquic_cnx_t** last_cnx,
+    uint64_t current_time)
+{
+    int ret = 0;
+    int is_batch_owner = !quic->is_receive_batch_open;
+
+    if (is_batch_owner) {
+        picoquic_receive_batch_start(quic);
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_datagrams; i++) {
+        const picoquic_incoming_datagram_t* datagram = &datagrams[i];
+        size_t segment_size = datagram->segment_size;
+        size_t recv_bytes = 0;
+
+        if (segment_size == 0 || segment_size >= datagram->length) {
+            segment_size = datagram->length;
+        }
+        else {
+            picoquic_prepare_header_masks(quic, datagram->bytes, datagram->length, segment_size);
+        }
+        while (recv_bytes < datagram->length && ret == 0) {
+            size_t recv_length = datagram->length - recv_bytes;
+
+            if (recv_length > segment_size) {
+                recv_length = segment_size;
+            }
+            ret = picoquic_incoming_packet_ts(quic, datagram->bytes + recv_bytes, recv_length,
+                datagram->addr_from, datagram->addr_to, datagram->if_index_to, datagram->received_ecn,
+                last_cnx, datagram->receive_time, current_time);
+            recv_bytes += recv_length;
+        }
+    }
+
+    if (is_batch_owner) {
+        picoquic_receive_batch_end(quic);
+    }
+
     return ret;
 }
 
@@ -2477,7 +2812,7 @@ void picoquic_process_sooner_packets(picoquic_cnx_t* cnx, uint64_t current_time)
             else {
                 previous->next_packet = packet->next_packet;
             }
-            picoquic_delete_stateless_packet(packet);
+            picoquic_delete_stateless_packet(cnx->quic, packet);
         }
         else {
             previous = packet;
@@ -0,0 +1,134 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Multipath schedulers.
+*
+* The path selection in paths.c handles the path challenges, the ACKs,
+* the streams that have an affinity to a specific path, and the datagrams.
+* The remaining decision is which of the paths authorized by pacing and
+* congestion control should carry the next packet. By default, that is the
+* path that was used least recently, which spreads the load evenly. The
+* schedulers below implement other policies:
+*
+* - lowest_rtt sends on the path with the lowest smoothed RTT, and only uses
+*   other paths when the congestion window of the fastest path is full.
+* - capacity sends on the path with the lowest estimated queuing delay,
+*   i.e., the bytes in transit divided by the estimated data rate, so that
+*   each path carries data in proportion of its capacity.
+* - redundant behaves like lowest_rtt, but small packets are also repeated
+*   on a second path. This reduces the latency of short urgent messages
+*   when one of the paths suffers losses or sudden delays, at the cost of
+*   the extra bytes.
+*/
+
+#include <string.h>
+#include "picoquic_internal.h"
+
+static int picoquic_lowest_rtt_select(picoquic_cnx_t* cnx,
+    picoquic_path_t** candidates, int nb_candidates, uint64_t current_time)
+{
+    int selected = -1;
+
+    for (int i = 0; i < nb_candidates; i++) {
+        if (selected < 0 || candidates[i]->smoothed_rtt < candidates[selected]->smoothed_rtt) {
+            selected = i;
+        }
+    }
+
+    return selected;
+}
+
+/* The capacity is in bytes per second. If the bandwidth estimate is not
+ * available yet, derive it from the congestion window.
+ */
+static uint64_t picoquic_path_scheduler_capacity(picoquic_path_t* path_x)
+{
+    uint64_t capacity = path_x->bandwidth_estimate;
+
+    if (capacity == 0 && path_x->smoothed_rtt > 0) {
+        capacity = (path_x->cwin * 1000000) / path_x->smoothed_rtt;
+    }
+    if (capacity == 0) {
+        capacity = 1;
+    }
+
+    return capacity;
+}
+
+static int picoquic_capacity_select(picoquic_cnx_t* cnx,
+    picoquic_path_t** candidates, int nb_candidates, uint64_t current_time)
+{
+    int selected = -1;
+    double best_delay = 0;
+    uint64_t best_capacity = 0;
+
+    for (int i = 0; i < nb_candidates; i++) {
+        uint64_t capacity = picoquic_path_scheduler_capacity(candidates[i]);
+        double delay = ((double)candidates[i]->bytes_in_transit) / ((double)capacity);
+
+        if (selected < 0 || delay < best_delay || (delay == best_delay && capacity > best_capacity)) {
+            selected = i;
+            best_delay = delay;
+            best_capacity = capacity;
+        }
+    }
+
+    return selected;
+}
+
+static picoquic_path_scheduler_t picoquic_lowest_rtt_scheduler_struct = {
+    "lowest_rtt", picoquic_lowest_rtt_select, 0
+};
+
+static picoquic_path_scheduler_t picoquic_capacity_scheduler_struct = {
+    "capacity", picoquic_capacity_select, 0
+};
+
+static picoquic_path_scheduler_t picoquic_redundant_scheduler_struct = {
+    "redundant", picoquic_lowest_rtt_select, PICOQUIC_REDUNDANT_PACKET_MAX
+};
+
+picoquic_path_scheduler_t const* picoquic_lowest_rtt_scheduler = &picoquic_lowest_rtt_scheduler_struct;
+picoquic_path_scheduler_t const* picoquic_capacity_scheduler = &picoquic_capacity_scheduler_struct;
+picoquic_path_scheduler_t const* picoquic_redundant_scheduler = &picoquic_redundant_scheduler_struct;
+
+picoquic_path_scheduler_t const* picoquic_get_path_scheduler(char const* scheduler_id)
+{
+    picoquic_path_scheduler_t const* schedulers[3] = {
+        &picoquic_lowest_rtt_scheduler_struct,
+        &picoquic_capacity_scheduler_struct,
+        &picoquic_redundant_scheduler_struct
+    };
+    picoquic_path_scheduler_t const* scheduler = NULL;
+
+    if (scheduler_id != NULL) {
+        for (size_t i = 0; i < sizeof(schedulers) / sizeof(schedulers[0]); i++) {
+            if (strcmp(scheduler_id, schedulers[i]->path_scheduler_id) == 0) {
+                scheduler = schedulers[i];
+                break;
+            }
+        }
+    }
+
+    return scheduler;
+}
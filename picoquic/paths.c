@@ -36,7 +36,7 @@ uint8_t* picoquic_prepare_tuple_challenge_frames(picoquic_cnx_t* cnx, picoquic_p
     int* more_data, int* is_pure_ack, int* is_challenge_padding_needed,
     uint64_t current_time, uint64_t* next_wake_time)
 {
-    if (tuple->challenge_verified == 0 && tuple->challenge_failed == 0) {
+    if ((tuple->challenge_verified == 0 || tuple->is_rebinding_pending) && tuple->challenge_failed == 0) {
         uint64_t next_challenge_time = picoquic_tuple_challenge_time(path_x, tuple, current_time);
 
         if (next_challenge_time > current_time) {
@@ -83,6 +83,13 @@ uint8_t* picoquic_prepare_tuple_challenge_frames(picoquic_cnx_t* cnx, picoquic_p
                     SET_LAST_WAKE(cnx->quic, PICOQUIC_SENDER);
                 }
             }
+            else if (tuple->is_rebinding_pending) {
+                /* The new port did not answer. Revert to the previous one, which was validated. */
+                picoquic_store_addr(&tuple->peer_addr, (struct sockaddr*)&tuple->rebinding_previous_addr);
+                tuple->is_rebinding_pending = 0;
+                tuple->challenge_required = 0;
+                picoquic_log_app_message(cnx, "Fast port rebinding failed on path %" PRIu64, path_x->unique_path_id);
+            }
             else {
                 /* This particular tuple failed.
                  * Update its status, and move it to the end of the list.
@@ -307,7 +314,7 @@ picoquic_tuple_t* picoquic_check_path_control_needed(picoquic_cnx_t* cnx, picoqu
             /* selected */
             break;
         }
-        else if (tuple->challenge_required && !tuple->challenge_verified) {
+        else if (tuple->challenge_required && (!tuple->challenge_verified || tuple->is_rebinding_pending)) {
             uint64_t next_challenge_time = picoquic_tuple_challenge_time(path_x, tuple, current_time);
             if (current_time >= next_challenge_time) {
                 break;
@@ -391,6 +398,9 @@ void picoquic_sort_available_paths(picoquic_cnx_t* cnx, uint64_t current_time, u
     int is_ack_needed = 0;
     picoquic_stream_head_t* next_stream = picoquic_find_ready_stream(cnx);
     int affinity_path_id = -1;
+    int redundant_path_id = -1;
+    picoquic_path_t* candidates[PICOQUIC_PATH_SCHEDULER_CANDIDATES_MAX];
+    int nb_candidates = 0;
 
     /* Several paths are available. We will chose from that.
      */
@@ -428,6 +438,13 @@ void picoquic_sort_available_paths(picoquic_cnx_t* cnx, uint64_t current_time, u
                     last_sent_cwin = path_x->last_sent_time;
                     data_path_cwin = path_index;
                 }
+                if (nb_candidates < PICOQUIC_PATH_SCHEDULER_CANDIDATES_MAX) {
+                    candidates[nb_candidates++] = path_x;
+                }
+                if (cnx->is_redundant_repeat_pending && redundant_path_id < 0 &&
+                    path_x->unique_path_id != cnx->redundant_source_path_id) {
+                    redundant_path_id = path_index;
+                }
                 if (affinity_path_id < 0) {
                     /* we select here the first path that is either ready to send on
                         * the highest priority stream with affinity on this path, or
@@ -466,6 +483,15 @@ void picoquic_sort_available_paths(picoquic_cnx_t* cnx, uint64_t current_time, u
         if (affinity_path_id >= 0) {
             *next_path = cnx->path[affinity_path_id];
         }
+        else if (redundant_path_id >= 0) {
+            /* Repeat the last small packet on a different path */
+            *next_path = cnx->path[redundant_path_id];
+        }
+        else if (cnx->path_scheduler != NULL) {
+            int selected = cnx->path_scheduler->select_path(cnx, candidates, nb_candidates, current_time);
+
+            *next_path = (selected >= 0 && selected < nb_candidates) ? candidates[selected] : cnx->path[data_path_cwin];
+        }
         else {
             *next_path = cnx->path[data_path_cwin];
         }
@@ -613,6 +639,33 @@ void picoquic_select_next_path_tuple(picoquic_cnx_t* cnx, uint64_t current_time,
  default path.
  */
 
+/* Check whether the packet comes from the same IP address as the first tuple
+ * of the path but from a different port, as happens when a NAT in front of the
+ * client changes its mapping. This is only handled by servers, for validated
+ * tuples, and only for the highest numbered packet received so far, so that
+ * late packets from the old port do not cause a switch back.
+ */
+static int picoquic_is_fast_port_rebinding(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_header* ph,
+    const struct sockaddr* addr_from, const struct sockaddr* addr_to)
+{
+    int is_rebinding = 0;
+    picoquic_tuple_t* tuple = path_x->first_tuple;
+
+    if (cnx->is_fast_port_rebinding && !cnx->client_mode && cnx->cnx_state == picoquic_state_ready &&
+        (tuple->challenge_verified || tuple->is_rebinding_pending) &&
+        addr_from->sa_family == tuple->peer_addr.ss_family &&
+        picoquic_compare_addr(addr_to, (struct sockaddr*)&tuple->local_addr) == 0 &&
+        picoquic_compare_ip_addr(addr_from, (struct sockaddr*)&tuple->peer_addr) == 0) {
+        picoquic_ack_context_t* ack_ctx = picoquic_ack_ctx_from_cnx_context(cnx, picoquic_packet_context_application, ph->l_cid);
+        uint64_t pn_last = picoquic_sack_list_last(&ack_ctx->sack_list);
+
+        if (pn_last == UINT64_MAX || ph->pn64 > pn_last) {
+            is_rebinding = 1;
+        }
+    }
+    return is_rebinding;
+}
+
 int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header* ph,
     struct sockaddr* addr_from,
     struct sockaddr* addr_to,
@@ -631,7 +684,7 @@ int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header* ph,
         * The packet decryption was successful, which means that the CID is valid,
         * but on the server side we might have a "probe".
          */
-        if (cnx->nb_paths < PICOQUIC_NB_PATH_TARGET &&
+        if (cnx->nb_paths < picoquic_get_max_simultaneous_paths(cnx->quic) &&
             (cnx->quic->is_port_blocking_disabled || !picoquic_check_addr_blocked(addr_from)) &&
             picoquic_create_path(cnx, current_time, addr_to, addr_from, if_index_to, ph->l_cid->path_id) > 0) {
             /* if we do create a new path, it should have the right path_id. We cannot
@@ -685,7 +738,28 @@ int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header* ph,
                 tuple = tuple->next_tuple;
             }
         }
-        if (tuple == NULL) {
+        if (tuple == NULL && picoquic_is_fast_port_rebinding(cnx, path_x, ph, addr_from, addr_to)) {
+            /* Pure port rebinding. Keep sending on the path with the current
+             * congestion state, reusing the first tuple, and validate the
+             * new port in the background. */
+            tuple = path_x->first_tuple;
+            if (!tuple->is_rebinding_pending) {
+                picoquic_store_addr(&tuple->rebinding_previous_addr, (struct sockaddr*)&tuple->peer_addr);
+                tuple->is_rebinding_pending = 1;
+            }
+            picoquic_store_addr(&tuple->peer_addr, addr_from);
+            tuple->if_index = if_index_to;
+            /* Counters at the time of the rebinding, for the three times
+             * amplification limit applied until the new port is validated */
+            tuple->rebinding_sent_base = path_x->bytes_sent;
+            tuple->rebinding_received_base = path_x->received;
+            tuple->is_nat_rebinding = 1;
+            tuple->challenge_required = 1;
+            picoquic_set_tuple_challenge(cnx->quic, tuple, current_time);
+            cnx->nb_fast_rebindings++;
+            picoquic_log_app_message(cnx, "Fast port rebinding on path %" PRIu64, path_x->unique_path_id);
+        }
+        else if (tuple == NULL) {
             /* If the addresses do not match, we have two possibilities:
             * either the creation of a new tuple, or a NAT rebinding on an existing tuple.
             * In all cases, we need to create a new tuple. In the NAt rebinding cases, we
@@ -696,7 +770,7 @@ int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header* ph,
             if (picoquic_check_cid_for_new_tuple(cnx, path_x->unique_path_id) == 0 &&
                 (tuple = picoquic_create_tuple(path_x, addr_to, addr_from, if_index_to)) != NULL) {
                 if (picoquic_assign_peer_cnxid_to_tuple(cnx, path_x, tuple) == 0) {
-                    picoquic_set_tuple_challenge(tuple, current_time, cnx->quic->use_constant_challenges);
+                    picoquic_set_tuple_challenge(cnx->quic, tuple, current_time);
                     tuple->challenge_required = 1;
                 }
             }
@@ -189,6 +189,9 @@ int picoquic_perflog_record(picoquic_cnx_t* cnx, picoquic_performance_log_ctx_t*
         if (cnx->congestion_alg != NULL) {
             perflog_item->v[picoquic_perflog_ccalgo] = cnx->congestion_alg->congestion_algorithm_number;
         }
+        perflog_item->v[picoquic_perflog_cpu_receive] = cnx->cpu_ticks_receive;
+        perflog_item->v[picoquic_perflog_cpu_prepare] = cnx->cpu_ticks_prepare;
+        perflog_item->v[picoquic_perflog_cpu_app] = cnx->cpu_ticks_app;
         
         if (perflog_ctx->first == NULL) {
             perflog_ctx->first = perflog_item;
@@ -270,6 +273,9 @@ const char* picoquic_perflog_param_name(picoquic_perflog_column_enum rank)
     case picoquic_perflog_bwe_max: return("bwe_max");
     case picoquic_perflog_pacing_quantum_max: return("p_quantum");
     case picoquic_perflog_pacing_rate: return("p_rate");
+    case picoquic_perflog_cpu_receive: return("cpu_recv");
+    case picoquic_perflog_cpu_prepare: return("cpu_prep");
+    case picoquic_perflog_cpu_app: return("cpu_app");
     default:
         break;
     }
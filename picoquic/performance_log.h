@@ -26,7 +26,7 @@ extern "C" {
 #endif
 
 #define PICOQUIC_PER_LOG_VERSION 1
-#define PICOQUIC_PERF_LOG_MAX_ITEMS 27
+#define PICOQUIC_PERF_LOG_MAX_ITEMS 30
 
 typedef enum {
     picoquic_perflog_is_client = 0,
@@ -55,7 +55,10 @@ typedef enum {
     picoquic_perflog_ccalgo = 23,
     picoquic_perflog_bwe_max = 24,
     picoquic_perflog_pacing_quantum_max = 25,
-    picoquic_perflog_pacing_rate = 26
+    picoquic_perflog_pacing_rate = 26,
+    picoquic_perflog_cpu_receive = 27, /* CPU ticks, if accounting enabled, see picoquic_set_cpu_accounting */
+    picoquic_perflog_cpu_prepare = 28,
+    picoquic_perflog_cpu_app = 29
 } picoquic_perflog_column_enum;
 
 const char* picoquic_perflog_param_name(picoquic_perflog_column_enum rank);
@@ -46,6 +46,7 @@ picohash_table* picohash_create_ex(size_t nb_bin,
         t = NULL;
     } else {
         (void)memset(t->hash_bin, 0, sizeof(picohash_item*) * nb_bin);
+        t->slots = NULL;
         t->nb_bin = nb_bin;
         t->count = 0;
         t->picohash_hash = picohash_hash;
@@ -64,17 +65,192 @@ picohash_table* picohash_create(size_t nb_bin,
     return picohash_create_ex(nb_bin, picohash_hash, picohash_compare, NULL, NULL);
 }
 
+/* Open addressing tables.
+ * Slots are kept in Robin Hood order: the distance of each entry from its
+ * home slot is never smaller than that of the entry before it, except when
+ * the previous entry is in its home slot. This bounds the length of probes,
+ * allows a failed lookup to stop as soon as it finds an entry closer to its
+ * home than the searched key, and allows deletion by shifting the following
+ * entries back, without tombstones.
+ */
+picohash_table* picohash_create_open(size_t nb_bin,
+    uint64_t(*picohash_hash)(const void*, const uint8_t*),
+    int (*picohash_compare)(const void*, const void*),
+    picohash_item* (*picohash_key_to_item)(const void*),
+    const uint8_t* hash_seed)
+{
+    static const uint8_t null_seed[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    picohash_table* t = NULL;
+    size_t nb_slots = 16;
+
+    /* Start with about as many bytes as the equivalent chained table,
+     * the array will grow if more entries are needed. */
+    while (nb_slots < nb_bin / 2 && nb_slots < (SIZE_MAX / (2 * sizeof(picohash_slot)))) {
+        nb_slots *= 2;
+    }
+
+    if (picohash_key_to_item != NULL &&
+        (t = (picohash_table*)malloc(sizeof(picohash_table))) != NULL) {
+        memset(t, 0, sizeof(picohash_table));
+        t->slots = (picohash_slot*)malloc(sizeof(picohash_slot) * nb_slots);
+        if (t->slots == NULL) {
+            free(t);
+            t = NULL;
+        }
+        else {
+            (void)memset(t->slots, 0, sizeof(picohash_slot) * nb_slots);
+            t->nb_bin = nb_slots;
+            t->count = 0;
+            t->picohash_hash = picohash_hash;
+            t->picohash_compare = picohash_compare;
+            t->picohash_key_to_item = picohash_key_to_item;
+            t->hash_seed = (hash_seed == NULL) ? null_seed : hash_seed;
+        }
+    }
+
+    return t;
+}
+
+static size_t picohash_open_distance(picohash_table* hash_table, size_t index, uint64_t hash)
+{
+    return (index - (size_t)hash) & (hash_table->nb_bin - 1);
+}
+
+static void picohash_open_place(picohash_table* hash_table, uint64_t hash, const void* key)
+{
+    size_t mask = hash_table->nb_bin - 1;
+    size_t index = (size_t)hash & mask;
+    size_t distance = 0;
+
+    while (hash_table->slots[index].key != NULL) {
+        size_t slot_distance = picohash_open_distance(hash_table, index, hash_table->slots[index].hash);
+        if (slot_distance < distance) {
+            /* Take the place of the entry closer to its home, and carry on with that one */
+            picohash_slot displaced = hash_table->slots[index];
+            hash_table->slots[index].hash = hash;
+            hash_table->slots[index].key = key;
+            hash = displaced.hash;
+            key = displaced.key;
+            distance = slot_distance;
+        }
+        index = (index + 1) & mask;
+        distance++;
+    }
+    hash_table->slots[index].hash = hash;
+    hash_table->slots[index].key = key;
+}
+
+static int picohash_open_grow(picohash_table* hash_table)
+{
+    int ret = 0;
+    size_t old_nb_slots = hash_table->nb_bin;
+    picohash_slot* old_slots = hash_table->slots;
+    picohash_slot* new_slots = NULL;
+
+    if (old_nb_slots < SIZE_MAX / (2 * sizeof(picohash_slot))) {
+        new_slots = (picohash_slot*)malloc(sizeof(picohash_slot) * 2 * old_nb_slots);
+    }
+    if (new_slots == NULL) {
+        ret = -1;
+    }
+    else {
+        (void)memset(new_slots, 0, sizeof(picohash_slot) * 2 * old_nb_slots);
+        hash_table->slots = new_slots;
+        hash_table->nb_bin = 2 * old_nb_slots;
+        for (size_t i = 0; i < old_nb_slots; i++) {
+            if (old_slots[i].key != NULL) {
+                picohash_open_place(hash_table, old_slots[i].hash, old_slots[i].key);
+            }
+        }
+        free(old_slots);
+    }
+    return ret;
+}
+
+static int picohash_open_insert(picohash_table* hash_table, const void* key, uint64_t hash, picohash_item* item)
+{
+    int ret = 0;
+
+    if (key == NULL || item == NULL) {
+        ret = -1;
+    }
+    else if ((hash_table->count + 1) * 8 > hash_table->nb_bin * 7) {
+        ret = picohash_open_grow(hash_table);
+    }
+
+    if (ret == 0) {
+        item->hash = hash;
+        item->key = key;
+        item->next_in_bin = NULL;
+        picohash_open_place(hash_table, hash, key);
+        hash_table->count++;
+    }
+
+    return ret;
+}
+
+/* Find the slot holding a key, by value if "by_pointer" is zero, or else by identity. */
+static picohash_slot* picohash_open_find(picohash_table* hash_table, const void* key, uint64_t hash, int by_pointer)
+{
+    size_t mask = hash_table->nb_bin - 1;
+    size_t index = (size_t)hash & mask;
+    size_t distance = 0;
+    picohash_slot* found = NULL;
+
+    while (hash_table->slots[index].key != NULL &&
+        picohash_open_distance(hash_table, index, hash_table->slots[index].hash) >= distance) {
+        if (hash_table->slots[index].hash == hash &&
+            ((by_pointer) ? hash_table->slots[index].key == key :
+                hash_table->picohash_compare(key, hash_table->slots[index].key) == 0)) {
+            found = &hash_table->slots[index];
+            break;
+        }
+        index = (index + 1) & mask;
+        distance++;
+    }
+
+    return found;
+}
+
+static void picohash_open_remove(picohash_table* hash_table, picohash_slot* slot)
+{
+    size_t mask = hash_table->nb_bin - 1;
+    size_t index = (size_t)(slot - hash_table->slots);
+    size_t next = (index + 1) & mask;
+
+    /* Shift back the following entries until one is empty or at home */
+    while (hash_table->slots[next].key != NULL &&
+        picohash_open_distance(hash_table, next, hash_table->slots[next].hash) > 0) {
+        hash_table->slots[index] = hash_table->slots[next];
+        index = next;
+        next = (next + 1) & mask;
+    }
+    hash_table->slots[index].hash = 0;
+    hash_table->slots[index].key = NULL;
+    hash_table->count--;
+}
+
 picohash_item* picohash_retrieve(picohash_table* hash_table, const void* key)
 {
     uint64_t hash = hash_table->picohash_hash(key, hash_table->hash_seed);
-    uint32_t bin = (uint32_t)(hash % hash_table->nb_bin);
-    picohash_item* item = hash_table->hash_bin[bin];
+    picohash_item* item = NULL;
 
-    while (item != NULL) {
-        if (hash_table->picohash_compare(key, item->key) == 0) {
-            break;
-        } else {
-            item = item->next_in_bin;
+    if (hash_table->slots != NULL) {
+        picohash_slot* slot = picohash_open_find(hash_table, key, hash, 0);
+        if (slot != NULL) {
+            item = hash_table->picohash_key_to_item(slot->key);
+        }
+    }
+    else {
+        uint32_t bin = (uint32_t)(hash % hash_table->nb_bin);
+        item = hash_table->hash_bin[bin];
+
+        while (item != NULL) {
+            if (hash_table->picohash_compare(key, item->key) == 0) {
+                break;
+            } else {
+                item = item->next_in_bin;
+            }
         }
     }
 
@@ -95,7 +271,9 @@ int picohash_insert(picohash_table* hash_table, const void* key)
         item = hash_table->picohash_key_to_item(key);
     }
 
-    if (item == NULL) {
+    if (hash_table->slots != NULL) {
+        ret = picohash_open_insert(hash_table, key, hash, item);
+    } else if (item == NULL) {
         ret = -1;
     } else {
         item->hash = hash;
@@ -111,20 +289,30 @@ int picohash_insert(picohash_table* hash_table, const void* key)
 void picohash_delete_item(picohash_table* hash_table, picohash_item* item, int delete_key_too)
 {
     uint32_t bin = (uint32_t)(item->hash % hash_table->nb_bin);
-    picohash_item* previous = hash_table->hash_bin[bin];
     const void* shall_delete = NULL;
 
-    if (previous == item) {
-        hash_table->hash_bin[bin] = item->next_in_bin;
-        hash_table->count--;
+    if (hash_table->slots != NULL) {
+        if (item->key != NULL) {
+            picohash_slot* slot = picohash_open_find(hash_table, item->key, item->hash, 1);
+            if (slot != NULL) {
+                picohash_open_remove(hash_table, slot);
+            }
+        }
     } else {
-        while (previous != NULL) {
-            if (previous->next_in_bin == item) {
-                previous->next_in_bin = item->next_in_bin;
-                hash_table->count--;
-                break;
-            } else {
-                previous = previous->next_in_bin;
+        picohash_item* previous = hash_table->hash_bin[bin];
+
+        if (previous == item) {
+            hash_table->hash_bin[bin] = item->next_in_bin;
+            hash_table->count--;
+        } else {
+            while (previous != NULL) {
+                if (previous->next_in_bin == item) {
+                    previous->next_in_bin = item->next_in_bin;
+                    hash_table->count--;
+                    break;
+                } else {
+                    previous = previous->next_in_bin;
+                }
             }
         }
     }
@@ -154,7 +342,17 @@ void picohash_delete_key(picohash_table* hash_table, void* key, int delete_key_t
 
 void picohash_delete(picohash_table* hash_table, int delete_key_too)
 {
-    if (hash_table->count > 0) {
+    if (hash_table->slots != NULL) {
+        if (delete_key_too) {
+            for (size_t i = 0; i < hash_table->nb_bin; i++) {
+                if (hash_table->slots[i].key != NULL) {
+                    free((void*)hash_table->slots[i].key);
+                }
+            }
+        }
+        free(hash_table->slots);
+    }
+    else if (hash_table->count > 0) {
         for (uint32_t i = 0; i < hash_table->nb_bin; i++) {
             picohash_item* item = hash_table->hash_bin[i];
             while (item != NULL) {
@@ -216,4 +414,76 @@ uint64_t picohash_siphash(const uint8_t* bytes, size_t length, const uint8_t* ha
         (((uint64_t)sip_out[6]) << 48) +
         (((uint64_t)sip_out[7]) << 56);
     return hash;
-}
\ No newline at end of file
+}
+/* SipHash-1-3, for the short keys of the connection tables.
+ * The full SipHash-2-4 used by picohash_siphash runs two compression rounds
+ * per 8 byte word and four finalization rounds, which dominates the cost of
+ * hashing the 6 to 34 bytes of an address, CID or reset secret. SipHash-1-3
+ * keeps the same keyed structure, and is the variant used by the hash tables
+ * of several language runtimes for resistance to hash flooding.
+ * The words are loaded directly instead of being copied byte by byte, and
+ * the fixed length variants let the compiler unroll the loop. */
+#define PICOHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define PICOHASH_SIPROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = PICOHASH_ROTL(v1, 13); v1 ^= v0; v0 = PICOHASH_ROTL(v0, 32); \
+        v2 += v3; v3 = PICOHASH_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = PICOHASH_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = PICOHASH_ROTL(v1, 17); v1 ^= v2; v2 = PICOHASH_ROTL(v2, 32); \
+    } while (0)
+
+static inline uint64_t picohash_load64_le(const uint8_t* p)
+{
+    return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+        ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint64_t picohash_siphash13_inline(const uint8_t* bytes, size_t length, const uint8_t* hash_seed)
+{
+    uint64_t k0 = picohash_load64_le(hash_seed);
+    uint64_t k1 = picohash_load64_le(hash_seed + 8);
+    uint64_t v0 = 0x736f6d6570736575ull ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dull ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ull ^ k0;
+    uint64_t v3 = 0x7465646279746573ull ^ k1;
+    uint64_t b = ((uint64_t)length) << 56;
+    size_t left = length & 7;
+    const uint8_t* end = bytes + length - left;
+
+    for (; bytes != end; bytes += 8) {
+        uint64_t m = picohash_load64_le(bytes);
+        v3 ^= m;
+        PICOHASH_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    for (size_t i = 0; i < left; i++) {
+        b |= ((uint64_t)bytes[i]) << (8 * i);
+    }
+
+    v3 ^= b;
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+    PICOHASH_SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t picohash_siphash13(const uint8_t* bytes, size_t length, const uint8_t* hash_seed)
+{
+    return picohash_siphash13_inline(bytes, length, hash_seed);
+}
+
+uint64_t picohash_siphash13_6(const uint8_t* bytes, const uint8_t* hash_seed)
+{
+    return picohash_siphash13_inline(bytes, 6, hash_seed);
+}
+
+uint64_t picohash_siphash13_18(const uint8_t* bytes, const uint8_t* hash_seed)
+{
+    return picohash_siphash13_inline(bytes, 18, hash_seed);
+}
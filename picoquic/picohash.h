@@ -39,9 +39,17 @@ typedef struct _picohash_item {
     const void* key;
 } picohash_item;
 
+/* Slot of an open addressing table. The hash is kept next to the key
+ * pointer, so most probes are resolved without touching the key. */
+typedef struct _picohash_slot {
+    uint64_t hash;
+    const void* key;
+} picohash_slot;
+
 typedef struct picohash_table {
     /* TODO: lock ! */
     picohash_item** hash_bin;
+    picohash_slot* slots; /* If not NULL, table uses open addressing instead of hash_bin */
     size_t nb_bin;
     size_t count;
     const uint8_t* hash_seed;
@@ -60,6 +68,18 @@ picohash_table* picohash_create_ex(size_t nb_bin,
     picohash_item* (*picohash_key_to_item)(const void*),
     const uint8_t* hash_seed);
 
+/* Open addressing variant, using Robin Hood linear probing in a power of 2
+ * array of slots that doubles when it is 7/8 full. Lookups touch one or two
+ * cache lines, and inserts do not allocate memory except when the array grows.
+ * Requires items embedded in the keys, i.e., picohash_key_to_item != NULL.
+ * The API is otherwise the same as for the chained tables.
+ */
+picohash_table* picohash_create_open(size_t nb_bin,
+    uint64_t(*picohash_hash)(const void*, const uint8_t*),
+    int (*picohash_compare)(const void*, const void*),
+    picohash_item* (*picohash_key_to_item)(const void*),
+    const uint8_t* hash_seed);
+
 picohash_item* picohash_retrieve(picohash_table* hash_table, const void* key);
 
 int picohash_insert(picohash_table* hash_table, const void* key);
@@ -74,6 +94,14 @@ uint64_t picohash_bytes(const uint8_t* key, size_t length, const uint8_t* hash_s
 
 uint64_t picohash_siphash(const uint8_t* bytes, size_t length, const uint8_t* hash_seed);
 
+/* SipHash-1-3, with fixed length variants for IPv4 (6 bytes) or IPv6
+ * (18 bytes) addresses with port. This is faster than picohash_siphash
+ * for short keys. Tables opt into it through the hash function passed to
+ * picohash_create_ex or picohash_create_open. */
+uint64_t picohash_siphash13(const uint8_t* bytes, size_t length, const uint8_t* hash_seed);
+uint64_t picohash_siphash13_6(const uint8_t* bytes, const uint8_t* hash_seed);
+uint64_t picohash_siphash13_18(const uint8_t* bytes, const uint8_t* hash_seed);
+
 #ifdef __cplusplus
 }
 #endif
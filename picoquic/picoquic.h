@@ -110,6 +110,11 @@ extern "C" {
 #define PICOQUIC_ERROR_PATH_ADDRESS_FAMILY (PICOQUIC_ERROR_CLASS + 66)
 #define PICOQUIC_ERROR_PATH_NOT_READY (PICOQUIC_ERROR_CLASS + 67)
 #define PICOQUIC_ERROR_PATH_LIMIT_EXCEEDED (PICOQUIC_ERROR_CLASS + 68)
+#define PICOQUIC_ERROR_INITIAL_RATE_LIMITED (PICOQUIC_ERROR_CLASS + 69)
+#define PICOQUIC_ERROR_CC_SNAPSHOT_MISMATCH (PICOQUIC_ERROR_CLASS + 70)
+#define PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL (PICOQUIC_ERROR_CLASS + 71)
+#define PICOQUIC_ERROR_INITIAL_QUEUED (PICOQUIC_ERROR_CLASS + 72)
+#define PICOQUIC_ERROR_CNX_NOT_EXPORTABLE (PICOQUIC_ERROR_CLASS + 73)
 
 /*
  * Protocol errors defined in the QUIC spec
@@ -140,7 +145,10 @@ extern "C" {
 #define PICOQUIC_TRANSPORT_UNSTABLE_INTERFACE (0x554e5f494e5446)
 #define PICOQUIC_TRANSPORT_NO_CID_AVAILABLE (0x4e4f5f4349445f)
 
+#ifndef PICOQUIC_MAX_PACKET_SIZE
 #define PICOQUIC_MAX_PACKET_SIZE 1536
+#endif
+#define PICOQUIC_MAX_JUMBO_PACKET_SIZE 9216
 #define PICOQUIC_INITIAL_MTU_IPV4 1252
 #define PICOQUIC_INITIAL_MTU_IPV6 1232
 #define PICOQUIC_RESET_SECRET_SIZE 16
@@ -283,7 +291,11 @@ typedef enum {
     picoquic_callback_path_quality_changed, /* Some path quality parameters have changed */
     picoquic_callback_path_address_observed, /* The peer has reported an address for the path */
     picoquic_callback_app_wakeup, /* wakeup timer set by application has expired */
-    picoquic_callback_next_path_allowed /* There are enough path_id and connection ID available for the next path */
+    picoquic_callback_next_path_allowed, /* There are enough path_id and connection ID available for the next path */
+    picoquic_callback_stream_data_batch, /* Data received in a batch on stream N, see picoquic_set_stream_data_batch_delivery */
+    picoquic_callback_datagram_batch, /* Datagrams received in a batch, see picoquic_set_datagram_batch_delivery */
+    picoquic_callback_send_backlog_high, /* Send backlog reached the high watermark, see picoquic_set_send_backlog_watermarks */
+    picoquic_callback_send_backlog_low /* Send backlog drained to the low watermark */
 } picoquic_call_back_event_t;
 
 typedef struct st_picoquic_tp_prefered_address_t {
@@ -329,6 +341,7 @@ typedef struct st_picoquic_tp_t {
     int is_multipath_enabled;
     uint64_t initial_max_path_id;
     int address_discovery_mode; /* 0=none, 1=provide only, 2=receive only, 3=both */
+    int enable_fec;
 } picoquic_tp_t;
 
 /*
@@ -372,10 +385,25 @@ typedef struct st_picoquic_tp_t {
 * The function "picoquic_get_quic_time()" returns the "virtual time" used by the specified quic
 * context, which can be either the current wall time or the simulated time, depending on how the
 * quic context was initialized.
+*
+* Reading the wall time is a system call on some platforms, and the stack calls
+* "picoquic_get_quic_time()" on many internal paths. When the clock cache is enabled
+* with "picoquic_set_clock_cache()", "picoquic_get_quic_time()" returns a cached value
+* instead of reading the clock. The cache is refreshed with the "current_time" passed to
+* the packet APIs, i.e., once per received packet or batch and once per send, or
+* explicitly with "picoquic_refresh_quic_time()", e.g., after the loop wakes up, which
+* reads the clock once and returns the value read. The cached time never goes
+* backward. Pacing and the loop keep using the current time that they read or
+* receive, so their precision is unchanged. The cache has no effect with
+* simulated time.
 */
 
 uint64_t picoquic_current_time(); /* wall time */
 uint64_t picoquic_get_quic_time(picoquic_quic_t* quic); /* connection time, compatible with simulations */
+void picoquic_set_clock_cache(picoquic_quic_t* quic, int enable);
+uint64_t picoquic_refresh_quic_time(picoquic_quic_t* quic);
+uint64_t picoquic_cpu_ticks(); /* cycle counter, see picoquic_set_cpu_accounting */
+uint64_t picoquic_thread_cpu_time(); /* CPU time of the calling thread in microseconds, 0 if not available */
 
 /* Callback function for providing stream data to the application,
  * and generally for notifying events from stack to application.
@@ -489,6 +517,24 @@ void picoquic_set_random_initial(picoquic_quic_t* quic, int random_initial);
 /* Set the "packet train" mode for pacing */
 void picoquic_set_packet_train_mode(picoquic_quic_t* quic, int train_mode);
 
+/* Set the pacing horizon, for applications that pass a departure time
+ * with each packet to the socket, e.g., using SO_TXTIME on Linux.
+ * Packets may be prepared up to horizon_microsec before their departure
+ * time. The departure time of the first packet produced by the last call to
+ * picoquic_prepare_packet_ex is returned by picoquic_get_departure_time_nanosec,
+ * in nanoseconds, on the same clock as the current time passed to the stack.
+ * The horizon applies to paths created after the call. When it is zero, the
+ * default, packets are only released at their departure time.
+ */
+void picoquic_set_pacing_horizon(picoquic_quic_t* quic, uint64_t horizon_microsec);
+uint64_t picoquic_get_departure_time_nanosec(picoquic_cnx_t* cnx);
+/* Departure time of the last packet sent on the path, in nanoseconds.
+ * Returns -1 if the path does not exist. */
+int picoquic_get_next_departure_time(picoquic_cnx_t* cnx, uint64_t unique_path_id, uint64_t* departure_nanosec);
+/* Number of full size packets that pacing lets the path send at the current
+ * time, which can be used to size a GSO batch. */
+size_t picoquic_get_pacing_burst_budget(picoquic_cnx_t* cnx, uint64_t unique_path_id, uint64_t current_time);
+
 /* set the padding policy.
  * The padding policy is parameterized by two variables:
  * - packets shorter than padding_min_size will be padded to that size.
@@ -524,6 +570,106 @@ uint32_t picoquic_current_number_connections(picoquic_quic_t * quic);
 void picoquic_set_max_half_open_retry_threshold(picoquic_quic_t* quic, uint32_t max_half_open_before_retry);
 uint32_t picoquic_get_max_half_open_retry_threshold(picoquic_quic_t* quic);
 
+/* Limit the rate of Initial packets that may create new connections, per
+ * source prefix (/24 for IPv4, /64 for IPv6). Each prefix can send up to
+ * "burst" packets at once, then "packets_per_second" packets per second.
+ * Packets above the limit are dropped before any decryption or allocation.
+ * Setting packets_per_second to zero disables the limiter, which is the default.
+ * picoquic_get_initial_rate_limited returns the number of packets dropped.
+ */
+int picoquic_set_initial_rate_limit(picoquic_quic_t* quic, uint64_t packets_per_second, uint64_t burst);
+uint64_t picoquic_get_initial_rate_limited(picoquic_quic_t* quic);
+
+/* Admission control of new connections. The server accepts to start at most
+ * "handshakes_per_second" new connections per second, with bursts of up to
+ * "burst" handshakes. Initial packets that would create a connection beyond
+ * that budget are queued, up to max_queued packets, and admitted when budget
+ * becomes available: first the packets carrying a valid Retry or NEW_TOKEN
+ * token, e.g., resuming clients, then the others, oldest first. Packets that
+ * do not fit in the queue, or that waited more than max_queue_delay
+ * microseconds (if not zero), are dropped, and the client will repeat them.
+ * Packets of existing connections are never queued. The queue is served at
+ * the end of each receive batch and by picoquic_prepare_next_packet_ex, and
+ * picoquic_get_next_wake_time accounts for it.
+ * Setting handshakes_per_second to zero disables admission control, which
+ * is the default, and drops the queued packets.
+ */
+typedef struct st_picoquic_admission_stats_t {
+    uint64_t nb_admitted_priority; /* with a valid token, directly or after queuing */
+    uint64_t nb_admitted; /* without token, directly or after queuing */
+    uint64_t nb_queued;
+    uint64_t nb_shed_queue_full;
+    uint64_t nb_shed_expired;
+    uint64_t queue_delay_total; /* sum of the queuing delays of admitted packets, microseconds */
+    uint64_t cpu_ticks; /* cost of the queued packets when admitted, if CPU accounting is enabled */
+    size_t queue_depth;
+    size_t queue_depth_max;
+} picoquic_admission_stats_t;
+
+int picoquic_set_admission_control(picoquic_quic_t* quic, size_t max_queued,
+    uint64_t handshakes_per_second, uint64_t burst, uint64_t max_queue_delay);
+void picoquic_get_admission_stats(picoquic_quic_t* quic, picoquic_admission_stats_t* stats);
+
+/* Compact closing state. When enabled, server connections that enter the
+ * closing or draining state, i.e., that have sent their CONNECTION_CLOSE,
+ * are replaced by a small record holding the local connection IDs, a copy
+ * of the datagram carrying the close, and the closing timer. The connection
+ * context, including TLS state and stream buffers, is deleted right away,
+ * and the application receives the close callback at that point.
+ * Packets later received for the connection IDs are answered by sending
+ * the stored datagram again, at a decreasing rate, or silently dropped if
+ * the connection was draining, instead of triggering stateless resets.
+ * At most max_records are kept, the oldest being removed first; zero means
+ * the maximum number of connections. Setting enable to zero removes the
+ * existing records, which is also the default.
+ */
+typedef struct st_picoquic_compact_closing_stats_t {
+    uint64_t nb_created;
+    uint64_t nb_close_resent;
+    uint64_t nb_absorbed; /* received packets not answered: draining, amplification or rate limit */
+    uint64_t nb_expired;
+    uint64_t nb_evicted;
+    size_t nb_current;
+} picoquic_compact_closing_stats_t;
+
+int picoquic_set_compact_closing(picoquic_quic_t* quic, int enable, size_t max_records);
+void picoquic_get_compact_closing_stats(picoquic_quic_t* quic, picoquic_compact_closing_stats_t* stats);
+
+/* Egress scheduler. By default, picoquic_prepare_next_packet_ex and
+ * picoquic_prepare_next_packets serve the connections in order of wake time,
+ * so a few connections sending bulk data can delay all the others. When
+ * the egress scheduler is enabled, the connections that are due to send are
+ * sorted in groups, e.g., tenants or applications, and the groups share the
+ * output by deficit round robin: each group is served in turn, for about
+ * "quantum" bytes per round. Groups marked "is_priority" are served before
+ * the others, in order of group ID. Each group can be rate limited, with a
+ * token bucket of "rate" bytes per second and "burst" bytes; the rate limit
+ * also applies to priority groups, so they cannot starve the others.
+ *
+ * The group of a connection is the value returned by the group_fn callback,
+ * if provided and if the value is a configured group ID, else the first
+ * group configured with the ALPN of the connection, else group 0. Within a
+ * group, ready connections are served in round robin order.
+ * The callback is called each time a connection becomes ready.
+ * Setting enable to zero disables the scheduler, which is the default.
+ */
+#define PICOQUIC_EGRESS_MAX_GROUPS 16
+#define PICOQUIC_EGRESS_QUANTUM_DEFAULT 16384
+
+typedef int (*picoquic_egress_group_fn)(picoquic_cnx_t* cnx, void* group_ctx);
+
+typedef struct st_picoquic_egress_group_stats_t {
+    uint64_t bytes_sent;
+    uint64_t nb_trains_sent; /* number of calls to prepare that produced data */
+    uint64_t nb_rate_limited; /* number of times the group was ready but over its rate */
+    size_t nb_ready; /* connections currently waiting for their turn */
+} picoquic_egress_group_stats_t;
+
+int picoquic_set_egress_scheduler(picoquic_quic_t* quic, int enable, picoquic_egress_group_fn group_fn, void* group_ctx);
+int picoquic_set_egress_group(picoquic_quic_t* quic, int group_id, char const* alpn, int is_priority,
+    uint64_t quantum, uint64_t rate, uint64_t burst);
+int picoquic_get_egress_group_stats(picoquic_quic_t* quic, int group_id, picoquic_egress_group_stats_t* stats);
+
 /* Obtain the reasons why a connection was closed */
 void picoquic_get_close_reasons(picoquic_cnx_t* cnx, uint64_t* local_reason,
     uint64_t* remote_reason, uint64_t* local_application_reason,
@@ -568,6 +714,51 @@ picoquic_quic_t* picoquic_create(uint32_t max_nb_connections,
 
 void picoquic_free(picoquic_quic_t* quic);
 
+/* QUIC groups.
+ * A QUIC context is driven by a single thread. A QUIC group creates
+ * nb_shards QUIC contexts, or shards, sharing the same configuration:
+ * certificates, default ALPN and callback, CID callback, stateless reset
+ * seed and session ticket key. Each shard owns its connection tables,
+ * object pools, stateless packet queue and wake up timers, so the shards
+ * can run on separate threads. The arguments are those of picoquic_create.
+ * If no ticket encryption key is provided, a random key is drawn once for
+ * the whole group. Session tickets and retry or new tokens issued by one
+ * shard are thus accepted by all the others, although the detection of
+ * token reuse is per shard. If no reset seed is provided, the group uses
+ * the random seed of the first shard. The ticket file is only loaded and
+ * saved by the first shard.
+ *
+ * Settings applied after creation, e.g. picoquic_set_default_tp or
+ * picoquic_set_alpn_select_fn, have to be applied to each shard.
+ * Shards can be handed to picoquic_start_sharded_server, see
+ * picoquic_quic_group_shard_create in picoquic_packet_loop.h.
+ */
+typedef struct st_picoquic_quic_group_t picoquic_quic_group_t;
+
+picoquic_quic_group_t* picoquic_create_quic_group(int nb_shards, uint32_t max_nb_connections,
+    char const* cert_file_name, char const* key_file_name, char const* cert_root_file_name,
+    char const* default_alpn,
+    picoquic_stream_data_cb_fn default_callback_fn,
+    void* default_callback_ctx,
+    picoquic_connection_id_cb_fn cnx_id_callback,
+    void* cnx_id_callback_data,
+    uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE],
+    uint64_t current_time,
+    uint64_t* p_simulated_time,
+    char const* ticket_file_name,
+    const uint8_t* ticket_encryption_key,
+    size_t ticket_encryption_key_length);
+int picoquic_quic_group_size(picoquic_quic_group_t* group);
+picoquic_quic_t* picoquic_quic_group_shard(picoquic_quic_group_t* group, int shard_id);
+/* Remove a shard from the group. The caller becomes responsible for freeing it. */
+picoquic_quic_t* picoquic_quic_group_release_shard(picoquic_quic_group_t* group, int shard_id);
+/* Free the group and the shards that were not released */
+void picoquic_delete_quic_group(picoquic_quic_group_t* group);
+/* Install or rotate the session ticket keys of all the shards, see
+ * picoquic_set_next_ticket_key and picoquic_rotate_ticket_keys */
+int picoquic_quic_group_set_next_ticket_key(picoquic_quic_group_t* group, uint8_t key_id, const uint8_t* key, size_t key_length);
+int picoquic_quic_group_rotate_ticket_keys(picoquic_quic_group_t* group, uint8_t key_id);
+
 /* Preference for low memory options.
  * setting this flag instructs picoquic to chose implementations of algorithms 
  * that use less memory while maintaining reasonable performance. For example,
@@ -575,6 +766,162 @@ void picoquic_free(picoquic_quic_t* quic);
  * which is a bit faster but requires an additional 7KB of data per connection */
 int picoquic_set_low_memory_mode(picoquic_quic_t* quic, int low_memory_mode);
 
+/* Choice of the structure used to schedule connection wake up times.
+ * By default, connections are kept in a splay tree sorted by wake time.
+ * Setting use_timer_wheel selects instead a hierarchical timer wheel,
+ * with O(1) insertion and retrieval, at the cost of about 32KB of memory.
+ * This is meant for servers handling many connections. The setting can be
+ * changed at any time; existing connections are moved to the new structure.
+ * Returns 0 if OK, -1 if the wheel could not be allocated.
+ */
+int picoquic_set_timer_wheel(picoquic_quic_t* quic, int use_timer_wheel);
+
+/* Timer coalescing, for battery powered clients.
+ * By default, each connection wakes up at the exact time of its next timer.
+ * When a timer slack is set (not zero, in microseconds), the wake times that
+ * are at least one slack away, such as delayed ACKs, keep alives, path probes
+ * or idle timers, are postponed to the next multiple of the slack. The timers
+ * of all connections then expire in shared slots, and the loop wakes up less
+ * often. Closer wake times, e.g., pacing of queued data, are not changed,
+ * and the loss detection and PTO deadlines are never postponed, so the
+ * slack does not add latency to loss recovery. The slack should stay well
+ * below the ACK delay, to avoid spurious retransmissions by the peer.
+ *
+ * The packet loops call picoquic_record_loop_wakeup each time they return
+ * from a blocking wait, whether because of a timer, a packet or a wake up
+ * event. Applications running their own loop can call it in the same way.
+ * picoquic_get_wakeup_stats reports the number of wake ups, and their
+ * rate, measured over the last full second.
+ */
+void picoquic_set_timer_slack(picoquic_quic_t* quic, uint64_t timer_slack);
+void picoquic_record_loop_wakeup(picoquic_quic_t* quic, uint64_t current_time);
+void picoquic_get_wakeup_stats(picoquic_quic_t* quic, uint64_t* nb_wakeups, uint64_t* wakeups_per_second);
+
+/* Object pools.
+ * Connection contexts, paths, tuples, stream heads and connection IDs are
+ * allocated from per-type pools attached to the QUIC context. Released objects
+ * are kept in the pool, up to "max_in_pool" objects per type, and reused for
+ * the next allocation instead of calling the allocator. Objects beyond that
+ * limit are returned to the allocator.
+ *
+ * Queued control frames such as NEW_CONNECTION_ID, RETIRE_CONNECTION_ID,
+ * NEW_TOKEN or PATH_* frames, as well as queued datagrams, are variable size.
+ * They are allocated from the smallest of three size classes that fits, with
+ * room for 64, 256 or PICOQUIC_MAX_PACKET_SIZE bytes of content.
+ *
+ * The allocator defaults to malloc and free. Applications can set a different
+ * backend, for example calling jemalloc's mallocx and sdallocx with a dedicated
+ * MALLOCX_ARENA. The backend can only be changed when no pooled object is in
+ * use, typically just after picoquic_create; the function returns -1 otherwise.
+ *
+ * The statistics describe the usage of each pool, and can be used to size
+ * the pools for the expected load. picoquic_preallocate_objects fills a pool
+ * with "nb_objects" free objects, raising max_in_pool if necessary.
+ */
+typedef enum {
+    picoquic_object_cnx = 0,
+    picoquic_object_path,
+    picoquic_object_tuple,
+    picoquic_object_stream,
+    picoquic_object_local_cnxid,
+    picoquic_object_remote_cnxid,
+    picoquic_object_misc_frame_small,
+    picoquic_object_misc_frame_medium,
+    picoquic_object_misc_frame_large,
+    picoquic_object_type_max
+} picoquic_object_type_enum;
+
+typedef struct st_picoquic_object_pool_stats_t {
+    size_t object_size; /* Size of each object, in bytes */
+    size_t nb_in_use; /* Number of objects currently allocated to the stack */
+    size_t nb_in_use_max; /* Highest value of nb_in_use since the pool was created */
+    size_t nb_in_pool; /* Number of free objects kept in the pool */
+    size_t max_in_pool; /* Maximum number of free objects kept in the pool */
+    uint64_t nb_alloc; /* Total number of allocations */
+    uint64_t nb_alloc_from_pool; /* Number of allocations served from the pool */
+} picoquic_object_pool_stats_t;
+
+typedef void* (*picoquic_object_alloc_fn)(void* allocator_ctx, size_t size);
+typedef void (*picoquic_object_free_fn)(void* allocator_ctx, void* object, size_t size);
+
+int picoquic_set_object_allocator(picoquic_quic_t* quic, picoquic_object_alloc_fn alloc_fn,
+    picoquic_object_free_fn free_fn, void* allocator_ctx);
+int picoquic_set_object_pool_size(picoquic_quic_t* quic, picoquic_object_type_enum object_type, size_t max_in_pool);
+int picoquic_preallocate_objects(picoquic_quic_t* quic, picoquic_object_type_enum object_type, size_t nb_objects);
+int picoquic_get_object_pool_stats(picoquic_quic_t* quic, picoquic_object_type_enum object_type,
+    picoquic_object_pool_stats_t* stats);
+
+/* Prewarming of the pools.
+ * The pools of packets and stream data nodes start empty, so that the first
+ * burst of traffic after startup goes through the allocator for every packet.
+ * picoquic_prewarm_pools fills the packet and data node pools with at least
+ * "nb_packets" and "nb_data_nodes" full size objects, raising the pool limits
+ * above PICOQUIC_MAX_PACKETS_IN_POOL if necessary. It also preallocates the
+ * objects needed by "nb_connections" connections: connection context, path,
+ * tuple, one stream head and the connection IDs allowed by the default
+ * transport parameters.
+ *
+ * If "use_huge_pages" is set, the packets and data nodes are carved from a
+ * single slab backed by huge pages when the system provides them. These
+ * objects remain in the pools until the QUIC context is deleted. Connection
+ * objects come from the object allocator; applications that want them in
+ * huge pages should install a matching allocator with picoquic_set_object_allocator.
+ *
+ * Returns 0 if OK, PICOQUIC_ERROR_MEMORY if an allocation failed.
+ */
+int picoquic_prewarm_pools(picoquic_quic_t* quic, size_t nb_packets, size_t nb_data_nodes,
+    size_t nb_connections, int use_huge_pages);
+
+/* Connection memory accounting.
+ * The stack accounts for the memory held by each connection in buffers whose
+ * size depends on the peer or the application: out of order stream data,
+ * data queued for sending, packets kept for retransmission, queued misc
+ * frames and queued datagrams. The getters return the number of bytes
+ * currently allocated, per category or in total, for a connection or for
+ * the whole QUIC context.
+ *
+ * A memory budget can be set per connection, or as default value for new
+ * connections. When the budget is set (not zero), the credit advertised to
+ * the peer in MAX_DATA frames is limited to the part of the budget that is
+ * not in use, and MAX_STREAM_DATA updates are withheld while the budget is
+ * exceeded. This bounds the amount of data a peer can push to the
+ * connection, at the cost of throughput if the budget is too small.
+ */
+typedef enum {
+    picoquic_memory_stream_receive = 0,
+    picoquic_memory_stream_send,
+    picoquic_memory_retransmit,
+    picoquic_memory_misc_frame,
+    picoquic_memory_datagram,
+    picoquic_memory_category_max
+} picoquic_memory_category_enum;
+
+size_t picoquic_get_cnx_memory_usage(picoquic_cnx_t* cnx, picoquic_memory_category_enum category);
+size_t picoquic_get_cnx_memory_total(picoquic_cnx_t* cnx);
+size_t picoquic_get_cnx_memory_max(picoquic_cnx_t* cnx);
+size_t picoquic_get_quic_memory_total(picoquic_quic_t* quic);
+void picoquic_set_default_cnx_memory_budget(picoquic_quic_t* quic, size_t memory_budget);
+void picoquic_set_cnx_memory_budget(picoquic_cnx_t* cnx, size_t memory_budget);
+size_t picoquic_get_cnx_memory_budget(picoquic_cnx_t* cnx);
+
+/* Hibernation of idle connections.
+ * When a hibernation delay is set (not zero), a connection in the ready
+ * state that has been quiet for that delay, with no data in flight and
+ * nothing queued for sending, is put in hibernation. The stack then
+ * releases the state that is only needed while the connection is active,
+ * such as the copies of packets kept after retransmission, the buffers
+ * of the discarded handshake crypto streams, or the empty stream index
+ * pages. Keys, connection identifiers, flow control state and paths are
+ * kept, so the connection wakes up as soon as a packet arrives or data
+ * is sent, and the released state is recreated on demand.
+ * The delay is in microseconds. The default value applies to connections
+ * created after it is set.
+ */
+void picoquic_set_default_hibernation_delay(picoquic_quic_t* quic, uint64_t hibernation_delay);
+void picoquic_set_hibernation_delay(picoquic_cnx_t* cnx, uint64_t hibernation_delay);
+int picoquic_is_cnx_hibernating(picoquic_cnx_t* cnx);
+uint64_t picoquic_get_nb_hibernations(picoquic_cnx_t* cnx);
+
 /* management of retry policy.
  * The cookie mode can be used to force the following behavior:
  * - if cookie_mode&1, check the token and force a retry for each incoming connection.
@@ -617,6 +964,14 @@ picoquic_tp_t const* picoquic_get_transport_parameters(picoquic_cnx_t* cnx, int
 /* Set the TLS certificate chain(DER format) for the QUIC context. The context will take ownership over the certs pointer. */
 void picoquic_set_tls_certificate_chain(picoquic_quic_t* quic, ptls_iovec_t* certs, size_t count);
 
+/* Enable or disable certificate compression (RFC 8879). Compression is enabled
+ * by default if the build found at least one of zlib, brotli or zstd. The server
+ * computes the compressed Certificate message once per certificate chain and
+ * reuses it for all handshakes. The client announces and decompresses the same
+ * algorithms. Returns -1 if enabling is requested but no algorithm is available.
+ */
+int picoquic_set_certificate_compression(picoquic_quic_t* quic, int enable);
+
 /* Set the TLS root certificates (DER format) for the QUIC context. The context will take ownership over the certs pointer.
  * The root certificates will be used to verify the certificate chain of the server and client (with client authentication activated).
  * Returns `0` on success, `-1` on error while loading X509 certificate or `-2` on error while adding a cert to the certificate store.
@@ -659,6 +1014,14 @@ int picoquic_set_spinbit_policy(picoquic_cnx_t* cnx, picoquic_spinbit_version_en
 /* Set default loss bit policy for the context */
 void picoquic_set_default_lossbit_policy(picoquic_quic_t* quic, picoquic_lossbit_version_enum default_lossbit_policy);
 
+/* Select the hash of the address, initial CID and reset secret tables,
+* which is computed over third party input for each incoming packet.
+* The default is SipHash-2-4. Setting use_siphash13 selects the faster
+* SipHash-1-3. This must be set before connections are created,
+* returns -1 if the tables are not empty.
+ */
+int picoquic_set_siphash13(picoquic_quic_t* quic, int use_siphash13);
+
 /* Set the multipath option for the context */
 void picoquic_set_default_multipath_option(picoquic_quic_t* quic, int multipath_option);
 
@@ -701,6 +1064,33 @@ void picoquic_set_cwin_max(picoquic_quic_t* quic, uint64_t cwin_max);
 */
 void picoquic_set_max_data_control(picoquic_quic_t* quic, uint64_t max_data);
 
+/* picoquic_set_receive_window_autotuning:
+* grow the flow control windows of streams and connections based on the
+* amount of data received per RTT, instead of the default policy. As in
+* the "dynamic right sizing" of Linux TCP, the window is set to twice
+* the data received in the last RTT, so it can double every RTT while the
+* peer is limited by flow control, and it never shrinks below the initial
+* credit. The window is capped by "max_window", and by the memory
+* budget of the connection if one is set.
+* Setting "max_window" to 0 (default) disables autotuning. The connection
+* level autotuning is not used if "picoquic_set_max_data_control" is set.
+*/
+void picoquic_set_receive_window_autotuning(picoquic_quic_t* quic, uint64_t max_window);
+
+/* picoquic_set_max_streams_autotuning:
+* grow the number of streams granted to the peer in each MAX_STREAMS frame
+* based on the rate at which remote streams are completed, instead of the
+* fixed increment set by the initial stream limits. The increment is set to
+* twice the number of streams completed in the last RTT, so a peer issuing
+* many short requests does not have to wait for credit. It also doubles
+* when the peer signals STREAMS_BLOCKED at the current limit. The increment
+* never goes below the initial limit, is capped by "max_increment", and by
+* the number of stream contexts that fit in the memory budget of the
+* connection if one is set.
+* Setting "max_increment" to 0 (default) disables autotuning.
+*/
+void picoquic_set_max_streams_autotuning(picoquic_quic_t* quic, uint64_t max_increment);
+
 /*
 * Idle timeout and handshake timeout
 * 
@@ -747,10 +1137,117 @@ int picoquic_is_local_cid(picoquic_quic_t* quic, picoquic_connection_id_t* cid);
 int picoquic_load_retry_tokens(picoquic_quic_t* quic, char const* token_store_filename);
 int picoquic_save_session_tickets(picoquic_quic_t* quic, char const* ticket_store_filename);
 int picoquic_save_retry_tokens(picoquic_quic_t* quic, char const* token_store_filename);
+/* Limit the number of session tickets or retry tokens kept by a client.
+ * When the limit is reached, the least recently used entries are evicted.
+ * The default value 0 means no limit.
+ */
+void picoquic_set_ticket_store_max(picoquic_quic_t* quic, size_t max_tickets);
+void picoquic_set_token_store_max(picoquic_quic_t* quic, size_t max_tokens);
+/* Careful Resume (draft-ietf-tsvwg-careful-resume): remember the RTT and
+ * congestion window of the connections that close after leaving startup,
+ * per peer address, for up to max_records addresses and during lifetime
+ * microseconds (0 for the default of one hour). New connections to the same
+ * address jump to half the saved window if their first RTT sample matches
+ * the saved RTT, and the saved values are dropped if losses happen before
+ * the jump is validated. Setting max_records to 0 disables the feature.
+ */
+int picoquic_set_careful_resume(picoquic_quic_t* quic, size_t max_records, uint64_t lifetime);
+/* Congestion manager: paths of different connections to the same peer
+ * address share one congestion window and one pacing budget, as if they were
+ * a single flow through the bottleneck. The paths are grouped by the first
+ * ipv4_prefix_bits or ipv6_prefix_bits of the peer address; 0 uses the full
+ * address. The aggregate window is the largest window computed by the
+ * congestion control of the members, and each path is guaranteed a share of
+ * it in proportion to the weight of its connection. New connections in a
+ * group start with the RTT of the group and their share of the window,
+ * instead of a slow start. Setting enable to 0 disables the feature; it
+ * should be set before creating connections.
+ */
+typedef struct st_picoquic_congestion_manager_stats_t {
+    uint64_t nb_groups; /* Groups currently active */
+    uint64_t nb_joined; /* Paths that joined a group with other members */
+    uint64_t nb_seeded; /* Connections that inherited the group estimates */
+    uint64_t nb_blocked; /* Transmissions deferred by the aggregate window or pacing */
+} picoquic_congestion_manager_stats_t;
+
+int picoquic_set_congestion_manager(picoquic_quic_t* quic, int enable, uint8_t ipv4_prefix_bits, uint8_t ipv6_prefix_bits);
+/* Weight of the connection in its groups, default 1 */
+void picoquic_set_congestion_manager_weight(picoquic_cnx_t* cnx, uint32_t weight);
+int picoquic_get_congestion_manager_stats(picoquic_quic_t* quic, picoquic_congestion_manager_stats_t* stats);
+/* PMTU cache: remember the path MTU validated by MTU probes, per peer address,
+ * for up to max_records addresses and during lifetime microseconds (0 for the
+ * default of ten minutes). New paths to the same address probe the cached
+ * value as soon as the handshake completes. Setting max_records to 0
+ * disables the feature.
+ */
+int picoquic_set_pmtu_cache(picoquic_quic_t* quic, size_t max_records, uint64_t lifetime);
+/* Anti-replay filter for 0-RTT: the server remembers the session tickets
+ * used during the last two windows of "window" microseconds (0 for the
+ * default of 10 seconds) in Bloom filters of nb_bits bits, and refuses the
+ * early data of connections that reuse a ticket. The connection proceeds
+ * without 0-RTT. Setting nb_bits to 0 disables the feature. The shared
+ * version maps the filters in a file, so that several server processes
+ * detect replays across processes; they shall all use the same parameters.
+ */
+int picoquic_set_anti_replay(picoquic_quic_t* quic, size_t nb_bits, uint64_t window);
+int picoquic_attach_shared_anti_replay(picoquic_quic_t* quic, char const* file_name, size_t nb_bits, uint64_t window);
+uint64_t picoquic_get_anti_replay_rejected(picoquic_quic_t* quic);
+/* Certificate verification cache: after the server certificate chain is
+ * validated, remember the leaf certificate and SNI for up to max_records
+ * servers and during lifetime microseconds (0 for the default of five
+ * minutes). Connections presenting the same leaf for the same SNI skip the
+ * chain validation; the handshake signature is still verified. This
+ * requires support by the crypto provider, currently OpenSSL. Setting
+ * max_records to 0 disables the feature.
+ */
+int picoquic_set_cert_verify_cache(picoquic_quic_t* quic, size_t max_records, uint64_t lifetime);
+void picoquic_get_cert_verify_cache_stats(picoquic_quic_t* quic, uint64_t* nb_hits, uint64_t* nb_misses);
+/* Share session tickets and retry tokens with the contexts of other processes
+ * that attach the same file. The file is mapped in memory and holds nb_slots
+ * records; all processes must use the same number of slots. Tickets and
+ * tokens received by any process can then be used by the others, and a
+ * ticket used by one process is removed from the shared store.
+ */
+int picoquic_attach_shared_ticket_store(picoquic_quic_t* quic, char const* file_name, size_t nb_slots);
+void picoquic_detach_shared_ticket_store(picoquic_quic_t* quic);
+/* Session ticket key ring. A server may protect its session tickets with a
+ * ring of up to three keys, identified by a one byte key ID: the next key,
+ * installed ahead of time, the current key, used for new tickets, and
+ * the previous key, still accepted after a rotation. Keys are truncated or
+ * padded to PICOQUIC_TICKET_KEY_SIZE bytes. Once the ring has a current
+ * key, it replaces the ticket encryption key of the context for session
+ * tickets; tickets issued before are no longer accepted. The keys may be
+ * installed and rotated while the server runs, from any thread. Setting the
+ * same next key or rotating to the same key twice has no effect, so that
+ * all the processes sharing a key table, or all the shards of a group, may
+ * do it. The first call to picoquic_set_next_ticket_key or to
+ * picoquic_attach_shared_ticket_keys shall be made before the context runs.
+ * The shared version maps the key table from a file.
+ */
+#define PICOQUIC_TICKET_KEY_SIZE 32
+int picoquic_set_next_ticket_key(picoquic_quic_t* quic, uint8_t key_id, const uint8_t* key, size_t key_length);
+int picoquic_rotate_ticket_keys(picoquic_quic_t* quic, uint8_t key_id);
+int picoquic_attach_shared_ticket_keys(picoquic_quic_t* quic, char const* file_name);
+int picoquic_get_current_ticket_key_id(picoquic_quic_t* quic, uint8_t* key_id);
 
 /* Manage bdps */
 void picoquic_set_default_bdp_frame_option(picoquic_quic_t* quic, int enable_bdp_frame);
 
+/* Experimental forward error correction extension.
+ * If negotiated by both ends, and if multipath is not used, the sender
+ * follows each block of block_size ack-eliciting 1-RTT packets with a
+ * repair frame carrying the XOR of their payloads. A receiver that misses
+ * exactly one packet of the block rebuilds it from the repair frame, and
+ * acknowledges it as if it had been received, so the sender neither
+ * retransmits it nor counts it as lost. Blocks are closed early when
+ * packets are sent more than a quarter RTT apart, so that sparse
+ * interactive traffic is protected too. Packets that are too long to fit
+ * a repair frame in a packet of the same size are not protected.
+ * Setting block_size to 0 disables the extension; values are capped at 16.
+ */
+void picoquic_set_default_fec_option(picoquic_quic_t* quic, uint8_t block_size);
+void picoquic_get_fec_stats(picoquic_cnx_t* cnx, uint64_t* nb_repairs_sent, uint64_t* nb_packets_recovered);
+
 /* Set default connection ID length for the context.
  * All valid values are supported on the client.
  * Using a null value on the server is not tested, may not work.
@@ -775,6 +1272,16 @@ uint64_t picoquic_get_default_connection_id_ttl(picoquic_quic_t* quic);
 #define PICOQUIC_MTU_OVERHEAD(p_s_addr) (((p_s_addr)->sa_family==AF_INET6)?48:28)
 void picoquic_set_mtu_max(picoquic_quic_t* quic, uint32_t mtu_max);
 
+/* Jumbo frames. Setting "mtu_max" above PICOQUIC_MAX_PACKET_SIZE, up to
+ * PICOQUIC_MAX_JUMBO_PACKET_SIZE, enables jumbo packets, for example on
+ * data center networks with a 9000 bytes MTU. Path MTU discovery then probes
+ * up to that value, and packets larger than PICOQUIC_MAX_PACKET_SIZE use
+ * a separate class of jumbo buffers. Applications that provide their own
+ * buffers to picoquic_prepare_next_packet_ex or picoquic_incoming_packet_ex
+ * should size them with picoquic_get_max_packet_size.
+ */
+size_t picoquic_get_max_packet_size(picoquic_quic_t* quic);
+
 
 /* Set the ALPN function used to verify incoming ALPN */
 void picoquic_set_alpn_select_fn(picoquic_quic_t* quic, picoquic_alpn_select_fn alpn_select_fn);
@@ -791,6 +1298,36 @@ void picoquic_set_default_callback(picoquic_quic_t * quic, picoquic_stream_data_
  */
 void picoquic_set_default_stateless_reset_min_interval(picoquic_quic_t* quic, uint64_t min_interval_usec);
 
+/* Number of undecryptable packets that were not checked against the table
+ * of stateless reset secrets, because their last 16 bytes did not match the
+ * fingerprint of any registered secret.
+ */
+uint64_t picoquic_get_nb_reset_filter_rejects(picoquic_quic_t* quic);
+
+/* Queue of stateless packets.
+ * Version negotiation, retry, stateless reset, busy and immediate close
+ * packets are queued in the QUIC context until the next call to
+ * picoquic_prepare_next_packet_ex. They are stored in a ring of nb_slots
+ * preallocated slots, allocated when the first stateless packet is queued,
+ * so that bursts of incoming packets do not cause allocations. The
+ * full_policy describes what happens when the ring is full: drop the new
+ * packet, drop the oldest queued packet, or allocate an extra packet
+ * outside the ring, which may send packets out of order. Drops are
+ * counted. Setting nb_slots to zero allocates every stateless packet, as
+ * does the allocate policy once the ring is full.
+ * The queue can only be changed while no stateless packet is queued; the
+ * function returns -1 otherwise.
+ * Default to PICOQUIC_STATELESS_RING_SIZE_DEFAULT slots, dropping new packets.
+ */
+typedef enum {
+    picoquic_stateless_full_drop_new = 0,
+    picoquic_stateless_full_drop_oldest,
+    picoquic_stateless_full_allocate
+} picoquic_stateless_full_policy_enum;
+
+int picoquic_set_stateless_queue(picoquic_quic_t* quic, size_t nb_slots, picoquic_stateless_full_policy_enum full_policy);
+uint64_t picoquic_get_nb_stateless_packets_dropped(picoquic_quic_t* quic);
+
 /* Set and get the maximum number of simultaneously logged connections.
 * If that number is too high, the maximum number of open files will be hit 
 * at random places in the code. A small value means that some connections may
@@ -811,6 +1348,32 @@ picoquic_cnx_t* picoquic_create_client_cnx(picoquic_quic_t* quic,
 
 int picoquic_start_client_cnx(picoquic_cnx_t* cnx);
 
+/* Happy eyeballs connection racing, see RFC 8305.
+ * The function creates a client connection to addr_first, started
+ * immediately, and a second connection to addr_second, typically over the
+ * other address family, started after race_delay microseconds or as soon as
+ * the first connection fails. Both connections use the same SNI, ALPN and
+ * stored session ticket. The first connection to complete the handshake wins,
+ * the other one is closed silently: its callbacks are not passed to the
+ * application any more.
+ *
+ * The function returns the first connection, which the application owns.
+ * The application should not queue streams or datagrams before the race
+ * is decided. When it receives the "almost ready" or "ready" callback,
+ * picoquic_get_race_winner returns the connection to use from then on.
+ * That function returns NULL while both connections are competing. Deleting
+ * either connection of the race deletes both.
+ *
+ * If addr_second is NULL or unspecified, the call is equivalent to
+ * picoquic_create_client_cnx.
+ */
+#define PICOQUIC_RACE_DELAY_DEFAULT 250000 /* 250 ms, per RFC 8305 */
+picoquic_cnx_t* picoquic_create_racing_cnx(picoquic_quic_t* quic,
+    struct sockaddr* addr_first, struct sockaddr* addr_second, uint64_t start_time, uint32_t preferred_version,
+    char const* sni, char const* alpn, picoquic_stream_data_cb_fn callback_fn, void* callback_ctx,
+    uint64_t race_delay);
+picoquic_cnx_t* picoquic_get_race_winner(picoquic_cnx_t* cnx);
+
 /* Closing the quic connection can be done in one of three ways.
  *
  * The function "picoquic_close" performs an ordered close. The "reason code"
@@ -971,6 +1534,37 @@ int picoquic_set_stream_path_affinity(picoquic_cnx_t* cnx, uint64_t stream_id, u
 int picoquic_set_path_status(picoquic_cnx_t* cnx, uint64_t unique_path_id, picoquic_path_status_enum status);
 int picoquic_subscribe_new_path_allowed(picoquic_cnx_t* cnx, int* is_already_allowed);
 
+/* The number of simultaneous paths per connection is limited to 8 by default.
+ * The limit can be raised up to PICOQUIC_NB_PATH_MAX. Setting 0 restores the
+ * default. When using multipath, the peers also limit the number of paths
+ * through the "initial_max_path_id" transport parameter, and the number of
+ * connection IDs through "active_connection_id_limit".
+ */
+#define PICOQUIC_NB_PATH_MAX 256
+void picoquic_set_max_simultaneous_paths(picoquic_quic_t* quic, int max_paths);
+int picoquic_get_max_simultaneous_paths(picoquic_quic_t* quic);
+
+/* Tuning of the capacity limits that used to be compile time constants:
+ * - max_packets_in_pool, max_data_nodes_in_pool: number of freed packets and
+ *   stream data nodes kept for reuse, default PICOQUIC_MAX_PACKETS_IN_POOL.
+ * - packet_loop_recv_max, packet_loop_send_max: number of datagrams received
+ *   or sent per iteration of the packet loop, default 10, capped at
+ *   PICOQUIC_PACKET_LOOP_BATCH_MAX.
+ * - max_simultaneous_paths: as in picoquic_set_max_simultaneous_paths.
+ * Setting a value to zero restores its default. picoquic_get_tuning
+ * returns the values in effect.
+ */
+typedef struct st_picoquic_tuning_t {
+    size_t max_packets_in_pool;
+    size_t max_data_nodes_in_pool;
+    size_t packet_loop_recv_max;
+    size_t packet_loop_send_max;
+    int max_simultaneous_paths;
+} picoquic_tuning_t;
+
+void picoquic_get_tuning(picoquic_quic_t* quic, picoquic_tuning_t* tuning);
+void picoquic_set_tuning(picoquic_quic_t* quic, const picoquic_tuning_t* tuning);
+
 /* The get path addr API provides the IP addresses used by a specific path.
 * The "local" argument determines whether the APi returns the local address
 * (local == 1), the address of the peer (local == 2) or the address observed by the peer (local == 3).
@@ -1030,6 +1624,186 @@ int picoquic_subscribe_to_quality_update_per_path(picoquic_cnx_t* cnx, uint64_t
 void picoquic_subscribe_to_quality_update(picoquic_cnx_t* cnx, uint64_t pacing_rate_delta, uint64_t rtt_delta);
 void picoquic_default_quality_update(picoquic_quic_t* quic, uint64_t pacing_rate_delta, uint64_t rtt_delta);
 
+/* Congestion control telemetry.
+ * When enabled, each path keeps a fixed size ring of congestion control samples,
+ * recorded by the network thread at most once per sample interval. A monitoring
+ * thread can read the ring at any time without locks: samples that are being
+ * overwritten while read are skipped.
+ *
+ * The handle is obtained by calling picoquic_get_cc_telemetry from the network
+ * thread, e.g., in the path quality or the connection callback. It remains valid
+ * after the path is deleted, until released with picoquic_release_cc_telemetry.
+ * The reader keeps track of the next sequence number to read, starting at 0.
+ * If the reader falls behind by more than the ring size, the oldest samples are
+ * lost and the sequence number jumps forward.
+ */
+typedef enum {
+    picoquic_slow_start_exit_none = 0, /* Still in initial slow start, or not reported by the algorithm */
+    picoquic_slow_start_exit_rtt, /* RTT increase detected by HyStart */
+    picoquic_slow_start_exit_css, /* RTT remained high during the HyStart++ CSS rounds */
+    picoquic_slow_start_exit_loss, /* Packet losses */
+    picoquic_slow_start_exit_ecn, /* ECN congestion experienced marks */
+    picoquic_slow_start_exit_timeout, /* Retransmission timer */
+    picoquic_slow_start_exit_ssthresh /* Window reached a seeded threshold */
+} picoquic_slow_start_exit_reason_t;
+
+typedef struct st_picoquic_cc_sample_t {
+    uint64_t sequence;
+    uint64_t sample_time;
+    uint64_t cwin;
+    uint64_t pacing_rate;
+    uint64_t bandwidth_estimate;
+    uint64_t rtt_min;
+    uint64_t smoothed_rtt;
+    uint64_t bytes_in_transit;
+    uint64_t cc_state; /* state reported by alg_observe, e.g., BBR state */
+    uint64_t cc_param; /* parameter reported by alg_observe */
+    uint64_t slow_start_exit_reason; /* picoquic_slow_start_exit_reason_t, none while in initial slow start */
+    uint64_t slow_start_exit_time;
+} picoquic_cc_sample_t;
+
+typedef struct st_picoquic_cc_telemetry_t picoquic_cc_telemetry_t;
+
+#define PICOQUIC_CC_TELEMETRY_INTERVAL 10000ull
+
+void picoquic_set_default_cc_telemetry(picoquic_quic_t* quic, size_t nb_samples, uint64_t sample_interval);
+picoquic_cc_telemetry_t* picoquic_get_cc_telemetry(picoquic_cnx_t* cnx, uint64_t unique_path_id);
+void picoquic_release_cc_telemetry(picoquic_cc_telemetry_t* telemetry);
+size_t picoquic_read_cc_telemetry(picoquic_cc_telemetry_t* telemetry, uint64_t* next_sequence,
+    picoquic_cc_sample_t* samples, size_t max_samples);
+int picoquic_cc_telemetry_is_closed(picoquic_cc_telemetry_t* telemetry);
+
+/* Connection statistics snapshots.
+ * When a publish interval is set (not zero), each new connection keeps a
+ * block of statistics that the network thread publishes at most once per
+ * interval, when preparing packets for the connection, and once more when
+ * the connection is deleted. Any thread can copy the last publication with
+ * picoquic_read_cnx_stats, without locks and without disturbing the network
+ * thread. The copy fails if nothing was published yet.
+ *
+ * As for the congestion control telemetry, the handle is obtained by calling
+ * picoquic_get_cnx_stats from the network thread, e.g., in the "almost ready"
+ * callback, and remains valid after the connection is deleted, until released
+ * with picoquic_release_cnx_stats.
+ */
+typedef struct st_picoquic_cnx_stats_t {
+    uint64_t sequence; /* number of the publication, starting at 1 */
+    uint64_t publish_time;
+    uint64_t cnx_state; /* value of picoquic_state_enum */
+    uint64_t nb_paths;
+    uint64_t data_sent; /* stream data bytes sent */
+    uint64_t data_received; /* stream data bytes received */
+    uint64_t nb_packets_sent;
+    uint64_t nb_packets_received;
+    uint64_t nb_retransmission_total;
+    uint64_t nb_spurious;
+    uint64_t send_backlog; /* see picoquic_get_send_backlog */
+    picoquic_path_quality_t default_path;
+} picoquic_cnx_stats_t;
+
+typedef struct st_picoquic_cnx_stats_block_t picoquic_cnx_stats_block_t;
+
+void picoquic_set_default_cnx_stats_interval(picoquic_quic_t* quic, uint64_t publish_interval);
+picoquic_cnx_stats_block_t* picoquic_get_cnx_stats(picoquic_cnx_t* cnx);
+void picoquic_release_cnx_stats(picoquic_cnx_stats_block_t* block);
+int picoquic_read_cnx_stats(picoquic_cnx_stats_block_t* block, picoquic_cnx_stats_t* stats);
+int picoquic_cnx_stats_is_closed(picoquic_cnx_stats_block_t* block);
+
+/* Context metrics.
+ * When enabled, the quic context maintains aggregated counters for all its
+ * connections. The network thread publishes a snapshot of these counters at
+ * most once per publish interval, when preparing packets, or when the
+ * application calls picoquic_publish_quic_metrics from the network thread.
+ * Any thread can copy the last snapshot with picoquic_get_quic_metrics,
+ * without locks: if the copy overlaps a publication, it is retried.
+ *
+ * Histograms count values in microseconds, with bucket upper bounds of
+ * 1, 2, 5, 10, 20, 50, 100, 200, 500 and 1000 milliseconds. The last
+ * bucket counts the larger values. Counts are per bucket, not cumulative.
+ * The snapshot also carries the latency histograms of the packet loop
+ * serving the context, if the loop was started with the metrics enabled.
+ *
+ * picoquic_format_openmetrics formats a snapshot in the OpenMetrics text
+ * format, and returns the length of the text, or 0 if the buffer is too
+ * small. The packet loop can serve that text over HTTP, see the
+ * metrics_port parameter in picoquic_packet_loop.h.
+ */
+#define PICOQUIC_METRICS_NB_BUCKETS 11
+#define PICOQUIC_METRICS_INTERVAL 1000000ull
+
+typedef struct st_picoquic_metrics_histogram_t {
+    uint64_t bucket[PICOQUIC_METRICS_NB_BUCKETS];
+    uint64_t nb_samples;
+    uint64_t sum; /* in microseconds */
+} picoquic_metrics_histogram_t;
+
+/* Latency histograms of the packet loop. The buckets are powers of two,
+ * in microseconds: bucket 0 counts values up to 1us, bucket i counts
+ * values larger than 2^(i-1) and up to 2^i microseconds, and the last
+ * bucket counts values larger than 2^20us, about one second. The loop
+ * measures the time spent waiting in select or epoll, processing each
+ * batch of received packets, preparing each packet, and in the send
+ * system calls, as well as the lag between the planned wake time and
+ * the time at which the wait actually returned. In busy poll mode, the
+ * spin histogram counts the time spent polling without blocking before
+ * each packet or wake up, or before falling back to a blocking wait.
+ */
+#define PICOQUIC_LATENCY_NB_BUCKETS 22
+
+typedef struct st_picoquic_latency_histogram_t {
+    uint64_t bucket[PICOQUIC_LATENCY_NB_BUCKETS];
+    uint64_t nb_samples;
+    uint64_t sum; /* in microseconds */
+    uint64_t max;
+} picoquic_latency_histogram_t;
+
+typedef struct st_picoquic_loop_latency_t {
+    picoquic_latency_histogram_t wait;
+    picoquic_latency_histogram_t receive;
+    picoquic_latency_histogram_t prepare;
+    picoquic_latency_histogram_t send;
+    picoquic_latency_histogram_t wake_lag;
+    picoquic_latency_histogram_t spin;
+} picoquic_loop_latency_t;
+
+void picoquic_latency_histogram_add(picoquic_latency_histogram_t* histogram, uint64_t value);
+
+typedef struct st_picoquic_quic_metrics_t {
+    uint64_t sequence; /* number of the publication, starting at 1 */
+    uint64_t publish_time;
+    uint64_t nb_connections_created;
+    uint64_t nb_connections_deleted;
+    uint64_t nb_handshakes; /* handshakes completed */
+    uint64_t handshake_rate; /* handshakes per second over the last publish interval */
+    uint64_t nb_active_connections;
+    uint64_t nb_half_open_connections;
+    uint64_t nb_packets_received;
+    uint64_t nb_packets_sent;
+    uint64_t nb_datagrams_received;
+    uint64_t nb_datagrams_sent;
+    uint64_t nb_bytes_received;
+    uint64_t nb_bytes_sent;
+    uint64_t nb_packets_lost; /* packets declared lost and queued for repeat */
+    uint64_t nb_spurious_losses; /* repeats that turned out to be spurious */
+    uint64_t nb_stateless_dropped;
+    uint64_t nb_packets_allocated;
+    uint64_t nb_packets_in_pool;
+    uint64_t nb_data_nodes_allocated;
+    uint64_t nb_data_nodes_in_pool;
+    uint64_t nb_objects_in_use; /* sum of all object pool types */
+    uint64_t nb_objects_in_pool;
+    uint64_t wake_list_size; /* connections in the wake tree or wheel */
+    picoquic_metrics_histogram_t rtt;
+    picoquic_metrics_histogram_t handshake_time;
+    picoquic_loop_latency_t loop_latency;
+} picoquic_quic_metrics_t;
+
+int picoquic_enable_quic_metrics(picoquic_quic_t* quic, uint64_t publish_interval);
+void picoquic_disable_quic_metrics(picoquic_quic_t* quic);
+void picoquic_publish_quic_metrics(picoquic_quic_t* quic, uint64_t current_time);
+int picoquic_get_quic_metrics(picoquic_quic_t* quic, picoquic_quic_metrics_t* metrics);
+size_t picoquic_format_openmetrics(const picoquic_quic_metrics_t* metrics, char* buf, size_t buf_size);
+
 /* Connection management API.
  * TODO: many of these API should be deprecated. They were created when we
  * envisaged that applications would directly manipulate which connection
@@ -1120,6 +1894,28 @@ int picoquic_queue_misc_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t
 #define PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH 1200
 int picoquic_queue_datagram_frame(picoquic_cnx_t* cnx, size_t length, const uint8_t* bytes);
 
+/* Datagram send ring.
+ * As an alternative to the "datagram ready" callbacks, the application can
+ * ask the stack to manage a ring of nb_slots preallocated buffers, each
+ * holding up to slot_size bytes (no more than PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH).
+ * Calling picoquic_set_datagram_send_ring with nb_slots = 0 frees the ring,
+ * discarding the queued datagrams.
+ *
+ * Each datagram is queued with a priority (lower values are sent first, as
+ * for streams) and an expiry time (0 if the datagram does not expire).
+ * Datagrams that have expired are dropped before sending. The stack packs as
+ * many queued datagrams as possible in each packet. If the ring is full,
+ * the queued datagram of lowest priority (highest value, most recently
+ * queued) is dropped to make room, provided its priority value is higher
+ * than that of the new datagram; otherwise, the call fails with
+ * PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL.
+ */
+int picoquic_set_datagram_send_ring(picoquic_cnx_t* cnx, size_t nb_slots, size_t slot_size);
+int picoquic_queue_datagram_to_ring(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length,
+    uint8_t priority, uint64_t expiry_time);
+void picoquic_get_datagram_ring_stats(picoquic_cnx_t* cnx, size_t* nb_queued,
+    uint64_t* nb_expired, uint64_t* nb_dropped);
+
 /* The incoming packet API is used to pass incoming packets to a 
  * Quic context. The API handles the decryption of the packets
  * and their processing in the context of connections.
@@ -1148,6 +1944,136 @@ int picoquic_incoming_packet_ex(
     picoquic_cnx_t** first_cnx,
     uint64_t current_time);
 
+/* Same as picoquic_incoming_packet_ex, but the packet is processed as
+ * received at receive_time, typically a kernel receive timestamp. This
+ * removes the scheduling delay between the arrival of the packet and the
+ * call from the RTT samples and from the delivery rate estimates.
+ * The receive time is ignored if it is zero or later than current_time.
+ * It should not be earlier than the time passed in previous calls to the stack.
+ */
+int picoquic_incoming_packet_ts(
+    picoquic_quic_t* quic,
+    uint8_t* bytes,
+    size_t packet_length,
+    struct sockaddr* addr_from,
+    struct sockaddr* addr_to,
+    int if_index_to,
+    unsigned char received_ecn,
+    picoquic_cnx_t** first_cnx,
+    uint64_t receive_time,
+    uint64_t current_time);
+
+/* Receive batches. When several datagrams are received together, for example
+ * through GRO or recvmmsg, the application can submit them between calls to
+ * picoquic_receive_batch_start and picoquic_receive_batch_end. The ACKs
+ * received in the batch are then aggregated, and the congestion control
+ * algorithm receives a single rate sample per path at the end of the batch.
+ * Without explicit batches, each call to picoquic_incoming_packet is
+ * processed as a batch of its own.
+ */
+void picoquic_receive_batch_start(picoquic_quic_t* quic);
+void picoquic_receive_batch_end(picoquic_quic_t* quic);
+
+/* Submit a batch of datagrams, for example the result of a recvmmsg call.
+ * A datagram with a non zero segment_size is a GRO buffer, split in segments
+ * of segment_size bytes. If no receive batch is open, the datagrams are
+ * processed as a single batch: the ACKs are aggregated, and the connections
+ * are reinserted in the wake list once, at the end of the batch. Short header
+ * packets with the same destination CID as the previous one skip the CID
+ * hash lookup. The receive_time of each datagram is handled as in
+ * picoquic_incoming_packet_ts, and is ignored if zero. On return, last_cnx
+ * points to the connection of the last datagram, if any.
+ */
+typedef struct st_picoquic_incoming_datagram_t {
+    uint8_t* bytes;
+    size_t length;
+    size_t segment_size;
+    struct sockaddr* addr_from;
+    struct sockaddr* addr_to;
+    int if_index_to;
+    unsigned char received_ecn;
+    uint64_t receive_time;
+} picoquic_incoming_datagram_t;
+
+int picoquic_incoming_packets(
+    picoquic_quic_t* quic,
+    const picoquic_incoming_datagram_t* datagrams,
+    size_t nb_datagrams,
+    picoquic_cnx_t** last_cnx,
+    uint64_t current_time);
+
+/* Within a receive batch, the application can submit a GRO buffer made of
+ * segments of segment_size bytes before processing the segments. The header
+ * protection masks of the short header packets for the same connection are
+ * then computed in a single call. The masks are cleared at the end of the batch,
+ * or when picoquic_clear_header_masks is called.
+ */
+void picoquic_prepare_header_masks(picoquic_quic_t* quic, const uint8_t* bytes, size_t length, size_t segment_size);
+void picoquic_clear_header_masks(picoquic_quic_t* quic);
+
+/* In place decryption of short header packets. By default, incoming packets
+ * are decrypted into a packet buffer allocated by the stack, and the bytes
+ * passed to picoquic_incoming_packet are not modified. If in place decryption
+ * is enabled, the 1-RTT packets are decrypted directly in the receive buffer,
+ * and the stack only allocates buffers for the stream data that has to be kept,
+ * e.g., data received out of order. The application shall not reuse the content
+ * of the receive buffer after the call. Data passed to the stream callbacks
+ * for these packets cannot be held with picoquic_hold_stream_data.
+ * The socket loop enables this for the buffers that it manages.
+ */
+void picoquic_set_in_place_decryption(picoquic_quic_t* quic, int is_enabled);
+
+/* CPU cost accounting. If enabled, the stack reads the cycle counter
+ * (see picoquic_cpu_ticks) when processing incoming packets, when preparing
+ * packets, and around the main application callbacks: stream data, prepare
+ * to send, datagrams and application wake up. The ticks are added to the
+ * connection, in three separate totals: receive and decrypt, prepare and
+ * encrypt, and application callbacks. The callback ticks are not counted in
+ * the receive or prepare totals. The values are reported in the performance
+ * log. They can be compared between connections of the same host, to find
+ * the connections that use most of the network thread.
+ */
+void picoquic_set_cpu_accounting(picoquic_quic_t* quic, int enable);
+void picoquic_get_cpu_ticks(picoquic_cnx_t* cnx, uint64_t* receive_ticks, uint64_t* prepare_ticks, uint64_t* app_ticks);
+
+/* Adaptive ACK frequency. If enabled, and if the ACK frequency extension
+ * is negotiated, the ACK gap and ACK delay requested from the peer follow
+ * the state of congestion control: fewer ACKs in steady state, more
+ * ACKs and an IMMEDIATE_ACK frame when congestion control starts probing
+ * for bandwidth. The reordering threshold follows the reordering observed
+ * on the path. If CPU accounting is also enabled, the ACK gap is doubled
+ * when the network thread is busy more than half of the time.
+ */
+void picoquic_set_adaptive_ack_frequency(picoquic_quic_t* quic, int enable);
+
+/* Asynchronous signing. On the server side, the signature of the certificate
+ * verify message is handed to a pool of nb_threads worker threads, and the
+ * handshake of the connection is parked until the signature is available.
+ * This must be called after the certificate and private key are set.
+ * When a job completes, the worker thread calls the wake function, if one
+ * is set, so the network thread can call picoquic_process_async_handshakes.
+ * That function is also called by picoquic_prepare_next_packet_ex, which
+ * means that without wake function the handshake resumes next time the
+ * application polls for packets to send.
+ * Returns the number of handshakes resumed.
+ */
+typedef void (*picoquic_async_wake_fn)(void* wake_ctx);
+int picoquic_enable_async_signing(picoquic_quic_t* quic, int nb_threads);
+void picoquic_set_async_wake_fn(picoquic_quic_t* quic, picoquic_async_wake_fn wake_fn, void* wake_ctx);
+int picoquic_process_async_handshakes(picoquic_quic_t* quic, uint64_t current_time);
+
+/* Pool of pregenerated ephemeral key shares. The key exchange algorithms
+ * of the TLS context are wrapped so that the key share of a handshake is
+ * drawn from a pool, refilled by a background thread. Each key share is
+ * used for exactly one handshake. The pool is sized to absorb the expected
+ * number of handshakes per second during one refill period, and falls back
+ * to generating keys in line when it runs out.
+ * This must be called after the key exchange algorithms are set, e.g.,
+ * after picoquic_set_key_exchange.
+ */
+int picoquic_enable_key_share_pool(picoquic_quic_t* quic, size_t handshakes_per_second);
+void picoquic_get_key_share_pool_stats(picoquic_quic_t* quic, uint64_t* nb_drawn, uint64_t* nb_missed);
+
 /* Applications must regularly poll the "next packet" API to obtain the
  * next packet that will be set over the network. The API for that is
  * picoquic_prepare_next_packet", which operates on a "quic context".
@@ -1167,6 +2093,35 @@ int picoquic_prepare_next_packet(picoquic_quic_t* quic,
     struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int* if_index,
     picoquic_connection_id_t* p_logcid, picoquic_cnx_t** p_last_cnx);
 
+/* Batch version of picoquic_prepare_next_packet_ex.
+ * The API prepares packets for as many ready connections as fit in the
+ * caller provided buffer and descriptor array, and describes each of them
+ * in a descriptor, which maps to one sendmmsg entry or one io_uring SQE.
+ * Each descriptor points to a slice of "send_buffer" holding one or several
+ * packets of "segment_size" bytes, at most "send_msg_max" bytes in total
+ * (one packet if send_msg_max is lower than PICOQUIC_MAX_PACKET_SIZE), to
+ * be sent with GSO if segment_size is lower than length. Slices are only
+ * started if at least PICOQUIC_MAX_PACKET_SIZE bytes remain in the buffer.
+ * The cnx pointer is NULL for stateless packets, and for connections that
+ * were deleted after closing while preparing the batch.
+ * The API returns when the buffer or the array is full, or when no
+ * stateless packet is queued and no connection is due at current_time.
+ */
+typedef struct st_picoquic_send_desc_t {
+    uint8_t* buffer;
+    size_t length;
+    size_t segment_size;
+    struct sockaddr_storage addr_to;
+    struct sockaddr_storage addr_from;
+    int if_index;
+    picoquic_connection_id_t log_cid;
+    picoquic_cnx_t* cnx;
+} picoquic_send_desc_t;
+
+int picoquic_prepare_next_packets(picoquic_quic_t* quic, uint64_t current_time,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t send_msg_max,
+    picoquic_send_desc_t* desc, size_t nb_desc_max, size_t* nb_desc);
+
 int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
     uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
     struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int* if_index,
@@ -1240,6 +2195,67 @@ typedef int (*picoquic_stream_direct_receive_fn)(picoquic_cnx_t* cnx,
 int picoquic_mark_direct_receive_stream(picoquic_cnx_t* cnx,
     uint64_t stream_id, picoquic_stream_direct_receive_fn direct_receive_fn, void* direct_receive_ctx);
 
+/* Holding received stream data without copying.
+ *
+ * The stream data passed to the stream data callback or to the direct receive
+ * callback is only valid for the duration of the callback. Applications that
+ * want to keep the data longer, e.g., to process it in a later step, would
+ * normally copy it. Instead, they may call picoquic_hold_stream_data from
+ * within the callback. The function returns a reference to the buffer that
+ * contains the data, and the data pointer passed to the callback remains
+ * valid until the application calls picoquic_release_stream_data.
+ *
+ * The function returns NULL if the data cannot be held, for example when no
+ * data is being delivered or the data does not reside in a packet buffer. The
+ * application shall then copy the data. Held buffers are not charged to the
+ * connection memory budget. They shall be released from the thread that runs
+ * the QUIC context, and before that context is freed.
+ */
+typedef struct st_picoquic_stream_data_node_t picoquic_stream_data_buffer_t;
+
+picoquic_stream_data_buffer_t* picoquic_hold_stream_data(picoquic_cnx_t* cnx);
+void picoquic_release_stream_data(picoquic_stream_data_buffer_t* buffer);
+
+/* Reassembly ring.
+ *
+ * By default, stream data received out of order is kept in a splay of data
+ * chunks until the missing data arrives. On paths with a large bandwidth-delay
+ * product, a single loss can cause thousands of chunks to be queued. The
+ * function picoquic_set_stream_reassembly_ring allocates a ring buffer of
+ * "ring_size" bytes for the stream. Received data is copied in the ring at
+ * its offset, and when a hole is filled the contiguous data is passed to the
+ * stream data callback in a single call, or two if the data wraps around the
+ * end of the ring.
+ *
+ * The ring size is rounded up to a multiple of 64, and to at least the flow
+ * control window already granted to the peer. Passing 0 sets the ring to that
+ * window. After that, the stream flow control window is capped to the ring size.
+ * The ring is ignored if the stream is marked as "direct receive".
+ *
+ * Returns PICOQUIC_ERROR_INVALID_STREAM_ID if the stream does not exist or is
+ * send only, PICOQUIC_ERROR_UNEXPECTED_STATE if the stream already has a ring.
+ */
+int picoquic_set_stream_reassembly_ring(picoquic_cnx_t* cnx, uint64_t stream_id, size_t ring_size);
+
+/* Application flow control.
+ *
+ * By default, the stream flow control credit is renewed as soon as the data
+ * is passed to the stream data callback. An application that holds on to
+ * received data, for example because it forwards it to a slow consumer,
+ * can call picoquic_set_app_flow_control. After that, the credit is only
+ * renewed when the application calls picoquic_stream_data_consumed with
+ * the offset of the data that it has finished processing, counted from the
+ * beginning of the stream. The offset is capped to the data already passed
+ * to the callback. When the feature is enabled, all the data already
+ * delivered is considered consumed. Disabling it releases the withheld credit.
+ *
+ * Returns PICOQUIC_ERROR_INVALID_STREAM_ID if the stream does not exist or
+ * is send only, or if picoquic_stream_data_consumed is called for a stream
+ * that is not under application flow control.
+ */
+int picoquic_set_app_flow_control(picoquic_cnx_t* cnx, uint64_t stream_id, int enable);
+int picoquic_stream_data_consumed(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t consumed_offset);
+
 /* Associate stream with app context */
 int picoquic_set_app_stream_ctx(picoquic_cnx_t* cnx,
     uint64_t stream_id, void* app_stream_ctx);
@@ -1332,6 +2348,40 @@ void picoquic_set_default_datagram_priority(picoquic_quic_t* quic, uint8_t defau
 
 void picoquic_set_datagram_priority(picoquic_cnx_t * cnx, uint8_t datagram_priority);
 
+/* Segment of application data, used by the scatter-gather stream API */
+typedef struct st_picoquic_iovec_t {
+    const uint8_t* base;
+    size_t len;
+} picoquic_iovec_t;
+
+/* Coalesced delivery of received data, for applications that handle many
+ * small messages. With stream batch delivery, the stream data received
+ * during a receive batch is delivered at the end of the batch, in a single
+ * "picoquic_callback_stream_data_batch" callback per stream. The "bytes"
+ * argument points to a picoquic_stream_data_batch_t structure listing the
+ * contiguous segments in order, and "length" is the total number of octets.
+ * The fin of the stream is signalled by "is_fin" in the same callback, not
+ * by a separate stream_fin event. The segments are only valid during the
+ * callback. Streams with a direct receive function or a reassembly ring
+ * keep their own delivery.
+ *
+ * With datagram batch delivery, the datagrams received during a receive
+ * batch are delivered in a single "picoquic_callback_datagram_batch"
+ * callback, with "bytes" pointing to an array of picoquic_iovec_t and
+ * "length" set to the number of datagrams. The stream_id argument is 0.
+ *
+ * Outside of receive batches, e.g. when packets are submitted with
+ * picoquic_incoming_segment, the data is delivered as usual.
+ */
+typedef struct st_picoquic_stream_data_batch_t {
+    const picoquic_iovec_t* iov;
+    size_t nb_iov;
+    int is_fin;
+} picoquic_stream_data_batch_t;
+
+void picoquic_set_stream_data_batch_delivery(picoquic_cnx_t* cnx, int enable);
+void picoquic_set_datagram_batch_delivery(picoquic_cnx_t* cnx, int enable);
+
 /* If a stream is marked active, the application will receive a callback with
  * event type "picoquic_callback_prepare_to_send" when the transport is ready to
  * send data on a stream. The "length" argument in the call back indicates the
@@ -1349,12 +2399,26 @@ void picoquic_set_datagram_priority(picoquic_cnx_t * cnx, uint8_t datagram_prior
 
 uint8_t* picoquic_provide_stream_data_buffer(void* context, size_t nb_bytes, int is_fin, int is_still_active);
 
+/* Variant of picoquic_provide_stream_data_buffer for applications that
+ * hold the data in several segments. The segments are copied in order in
+ * the stream frame, up to the "length" argument of the prepare to send
+ * callback, and the function returns the number of bytes copied. If not
+ * all bytes fit, the fin is not set and the stream remains active, so the
+ * application will be called again to provide the remaining bytes.
+ * On error, e.g., if the context is not valid, returns SIZE_MAX.
+ */
+size_t picoquic_provide_stream_data_iov(void* context, const picoquic_iovec_t* iov, size_t nb_iov,
+    int is_fin, int is_still_active);
+
 /* Queue data on a stream, so the transport can send it immediately
  * when ready. The data is copied in an intermediate buffer managed by
- * the transport. Calling this API automatically erases the "active
- * mark" that might have been set by using "picoquic_mark_active_stream".
- * It also erases the "app_stream_ctx" value set in previous calls to
- * picoquic_add_to_stream_with_ctx or picoquic_mark_active_stream
+ * the transport. The buffer is freed once the data is sent, or once it is
+ * acknowledged if lost data is resent from the stream, see
+ * picoquic_set_stream_repeat_from_queue_policy. Calling this API
+ * automatically erases the "active mark" that might have been set by
+ * using "picoquic_mark_active_stream". It also erases the "app_stream_ctx"
+ * value set in previous calls to picoquic_add_to_stream_with_ctx or
+ * picoquic_mark_active_stream
  */
 int picoquic_add_to_stream(picoquic_cnx_t* cnx,
     uint64_t stream_id, const uint8_t* data, size_t length, int set_fin);
@@ -1366,6 +2430,88 @@ void picoquic_reset_stream_ctx(picoquic_cnx_t* cnx, uint64_t stream_id);
  */
 int picoquic_add_to_stream_with_ctx(picoquic_cnx_t * cnx, uint64_t stream_id, const uint8_t * data, size_t length, int set_fin, void * app_stream_ctx);
 
+/* Same as "picoquic_add_to_stream_with_ctx", but the data is provided as
+ * a list of segments, e.g., a header block and a body slice. The segments
+ * are copied in a single buffer, and queued as a single chunk of data.
+ */
+int picoquic_add_to_stream_iov(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const picoquic_iovec_t* iov, size_t nb_iov, int set_fin, void* app_stream_ctx);
+
+/* Same as "picoquic_add_to_stream_with_ctx", but the data is not copied.
+ * The transport keeps a reference to the application buffer, and copies
+ * the bytes directly into the packets. This avoids one copy per call when the
+ * same buffer is sent on many streams or connections. The application must not
+ * modify or free the buffer until the transport calls release_fn, which
+ * happens once all the bytes are sent, or if the stream is reset or the
+ * connection deleted before that. The copies of the data in the sent packets
+ * are used for retransmissions, so the buffer is not needed after sending,
+ * unless lost data is resent from the stream: release_fn is then called once
+ * all the bytes are acknowledged. If the call fails, release_fn is not
+ * called and the application keeps the ownership of the buffer. If length
+ * is 0, the buffer is not referenced and release_fn is not called.
+ */
+typedef void (*picoquic_stream_data_release_fn)(void* release_ctx, const uint8_t* data, size_t length);
+
+int picoquic_add_to_stream_zero_copy(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx);
+
+/* Write coalescing. Applications that queue many small messages, e.g., RPC
+ * frames, can "cork" a stream, or all the streams of a connection. While
+ * corked, the data passed to picoquic_add_to_stream and its copying variants
+ * is appended to a single buffer per stream and is not sent. The buffer is
+ * queued for sending when the stream is uncorked, when it reaches
+ * 16KB, when the FIN is requested, or before
+ * data queued with picoquic_add_to_stream_zero_copy. Data is held while
+ * either the stream or the connection is corked.
+ */
+int picoquic_cork_stream(picoquic_cnx_t* cnx, uint64_t stream_id);
+int picoquic_uncork_stream(picoquic_cnx_t* cnx, uint64_t stream_id);
+void picoquic_cork_cnx(picoquic_cnx_t* cnx);
+void picoquic_uncork_cnx(picoquic_cnx_t* cnx);
+
+/* Send backlog watermarks. The send backlog is the number of bytes queued
+ * with picoquic_add_to_stream and its variants, including coalesced data,
+ * that are not yet sent. It is kept per stream and per connection.
+ * When watermarks are set (high not zero), the application receives a
+ * "picoquic_callback_send_backlog_high" event when the backlog reaches
+ * the high watermark, and then a "picoquic_callback_send_backlog_low" event
+ * when it drains to the low watermark. The "length" argument is the
+ * backlog, and the stream_id is UINT64_MAX for the connection events.
+ * The high event is issued from within the call that queues the data, the
+ * low event when data is sent. Producers can stop at the high event and
+ * resume at the low event, bounding memory without starving the connection.
+ * Setting a low watermark that is not lower than the high one is an error.
+ *
+ * picoquic_get_send_headroom returns the number of bytes that could be sent
+ * now, given the congestion window of the default path and the flow control
+ * credit of the connection, and of the stream unless stream_id is UINT64_MAX.
+ * Keeping the backlog above the headroom keeps the pipe full.
+ */
+int picoquic_set_send_backlog_watermarks(picoquic_cnx_t* cnx, uint64_t high, uint64_t low);
+int picoquic_set_stream_send_backlog_watermarks(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t high, uint64_t low);
+uint64_t picoquic_get_send_backlog(picoquic_cnx_t* cnx);
+uint64_t picoquic_get_stream_send_backlog(picoquic_cnx_t* cnx, uint64_t stream_id);
+uint64_t picoquic_get_send_headroom(picoquic_cnx_t* cnx, uint64_t stream_id);
+
+/* Delivery deadlines, for media streams carrying data that is useless
+ * if it arrives late. Once the deadline of data that is not yet acknowledged
+ * has passed, the transport does not send or retransmit that data. Since
+ * the stream cannot have holes, the stream is reset with the error code
+ * "expiry_error", and the bandwidth goes to fresh data on other streams.
+ * The deadlines are absolute times, in the same time base as the
+ * "current_time" passed to the stack.
+ * picoquic_set_stream_deadline sets a deadline for all the data of the
+ * stream, or removes it if the deadline is 0.
+ * picoquic_add_to_stream_with_deadline is the same as
+ * picoquic_add_to_stream_with_ctx, but the deadline only applies to
+ * the bytes queued in this call.
+ */
+int picoquic_set_stream_deadline(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t deadline, uint64_t expiry_error);
+
+int picoquic_add_to_stream_with_deadline(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx, uint64_t deadline);
+
 /* Reset a stream, indicating that no more data will be sent on 
  * that stream and that any data currently queued can be abandoned. */
 int picoquic_reset_stream(picoquic_cnx_t* cnx,
@@ -1439,6 +2585,16 @@ int picoquic_mark_datagram_ready_path(picoquic_cnx_t* cnx, uint64_t unique_path_
  *   datagram, and then do the equivalent of a call to "picoquic_mark_datagram_ready"
  *   with the value of is_active parameter.
  * 
+ * - if the application has several small datagrams ready, it may call
+ *   "picoquic_provide_datagram_buffer_ex" several times during the same
+ *   callback, filling each buffer before requesting the next one. Each
+ *   datagram is sent in its own DATAGRAM frame, placed after the previous
+ *   one in the same packet. The space available for the next datagram is
+ *   the callback "length" minus the bytes already used, minus 1 byte for
+ *   the frame type and the size of the length field of each additional
+ *   frame. A NULL return means that the datagram does not fit in the
+ *   remaining space, and should be kept for the next callback.
+ * 
  * The old API will not treat those scenarios as reliably. If the application
  * is polled and has nothing to send, it MUST call
  * " picoquic_mark_datagram_ready(cnx, 0);" to tell the stack to not call
@@ -1488,6 +2644,50 @@ void picoquic_set_optimistic_ack_policy(picoquic_quic_t* quic, uint32_t sequence
 void picoquic_set_preemptive_repeat_policy(picoquic_quic_t* quic, int do_repeat);
 void picoquic_set_preemptive_repeat_per_cnx(picoquic_cnx_t* cnx, int do_repeat);
 
+/* Resend lost stream data from the send queue of the stream instead of
+ * copying it from the lost packet. Each buffer queued with
+ * picoquic_add_to_stream and its variants is kept in a "retained" list of
+ * the stream after it is sent, until the peer acknowledges all its bytes.
+ * When a packet is lost, its stream frames are recorded as ranges of the
+ * stream, merged with the contiguous ranges already lost, and rebuilt from
+ * the retained data when there is room to send them. Lost packets are
+ * released as soon as the loss is processed, and unless preemptive or
+ * redundant repeats are enabled, packets waiting for acknowledgement only
+ * keep the metadata of their stream frames.
+ * Data provided with picoquic_add_to_stream_zero_copy is released to the
+ * application after it is acknowledged, not after it is sent.
+ *
+ * Memory cost: the stack holds the sent and unacknowledged data of each
+ * stream, which is bounded by the bytes in flight and by the flow control
+ * window of the peer, plus one small record per lost range. A buffer is
+ * only freed when all its bytes are acknowledged, so streams queued with
+ * large buffers hold more memory than the bytes in flight until the last
+ * bytes are acknowledged. In exchange, the packets waiting for
+ * acknowledgement hold a small container instead of a full size one.
+ * Data provided through the prepare to send callback is not retained, and
+ * is still resent from the lost packets.
+ *
+ * The policy applies to new connections, the per connection call
+ * to data sent after the call.
+ */
+void picoquic_set_stream_repeat_from_queue_policy(picoquic_quic_t* quic, int from_queue);
+void picoquic_set_stream_repeat_from_queue(picoquic_cnx_t* cnx, int from_queue);
+
+/* Fast port rebinding. When a server receives the highest numbered packet
+ * of a connection from the same IP address as the current peer address but
+ * from a different port, as happens when a NAT in front of the client
+ * changes its mapping, it switches to the new port immediately instead of
+ * creating a new tuple and waiting for its validation. Sending continues
+ * with the current congestion state, limited to three times the bytes
+ * received from the new port until a path challenge on that port succeeds.
+ * If the challenge fails, the server reverts to the previous port.
+ * The context policy applies to connections created after the call, the
+ * per connection call applies from the next port change.
+ */
+void picoquic_set_fast_port_rebinding_policy(picoquic_quic_t* quic, int enable);
+void picoquic_set_fast_port_rebinding(picoquic_cnx_t* cnx, int enable);
+uint64_t picoquic_get_nb_fast_rebindings(picoquic_cnx_t* cnx);
+
 /* Enables keep alive for a connection.
  * Keep alive interval is expressed in microseconds.
  * If `interval` is `0`, it is set to `idle_timeout / 2`.
@@ -1540,6 +2740,7 @@ typedef struct st_picoquic_per_ack_state_t {
     uint64_t nb_bytes_newly_lost; /* Number of bytes in packets found lost because of this ACK */
     uint64_t nb_bytes_lost_since_packet_sent; /* Number of bytes lost between the time the packet was sent and now */
     uint64_t nb_bytes_delivered_since_packet_sent; /* Number of bytes acked between the time the packet was sent and now */
+    uint64_t nb_bytes_ce_marked; /* Part of nb_bytes_acknowledged in packets to which CE marks were attributed */
     uint64_t inflight_prior;
     uint64_t lost_packet_number;
     uint64_t lost_packet_sent_time;
@@ -1557,6 +2758,15 @@ typedef void (*picoquic_congestion_algorithm_notify)(
 typedef void (*picoquic_congestion_algorithm_delete)(picoquic_path_t* cnx);
 typedef void (*picoquic_congestion_algorithm_observe)(
     picoquic_path_t* path_x, uint64_t * cc_state, uint64_t * cc_param);
+/* Export and import of the algorithm specific part of a congestion control
+ * snapshot. Export returns a pointer after the last encoded byte, import
+ * a pointer after the last decoded byte, or NULL if the buffer is too short
+ * or the content is not valid. Time stamps are encoded relative to current_time.
+ */
+typedef uint8_t* (*picoquic_congestion_algorithm_export)(
+    picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time);
+typedef const uint8_t* (*picoquic_congestion_algorithm_import)(
+    picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time);
 
 typedef struct st_picoquic_congestion_algorithm_t {
     char const * congestion_algorithm_id;
@@ -1565,6 +2775,8 @@ typedef struct st_picoquic_congestion_algorithm_t {
     picoquic_congestion_algorithm_notify alg_notify;
     picoquic_congestion_algorithm_delete alg_delete;
     picoquic_congestion_algorithm_observe alg_observe;
+    picoquic_congestion_algorithm_export alg_export;
+    picoquic_congestion_algorithm_import alg_import;
 } picoquic_congestion_algorithm_t;
 
 #define PICOQUIC_DEFAULT_CONGESTION_ALGORITHM picoquic_newreno_algorithm;
@@ -1588,6 +2800,96 @@ void picoquic_set_default_congestion_algorithm_by_name(picoquic_quic_t* quic, ch
 void picoquic_set_congestion_algorithm(picoquic_cnx_t* cnx, picoquic_congestion_algorithm_t const* algo);
 void picoquic_set_congestion_algorithm_ex(picoquic_cnx_t* cnx, picoquic_congestion_algorithm_t const* alg, char const* alg_option_string);
 
+/* HyStart++ (RFC 9406). When enabled, the newreno, cubic and prague algorithms
+ * do not leave slow start at the first RTT increase. They move instead to
+ * Conservative Slow Start (CSS), growing the window four times slower, and only
+ * exit slow start if the RTT stays high for 5 rounds. A CSS phase triggered by
+ * a transient increase ends when the RTT goes back below the CSS baseline.
+ * The setting applies to connections created afterwards. Off by default.
+ */
+void picoquic_set_hystart_pp(picoquic_quic_t* quic, int enable);
+
+/* Multipath schedulers.
+ * When several paths are available, the stack first checks whether ACKs
+ * are needed and whether a stream with path affinity or a datagram can be
+ * sent on one of them. If not, the scheduler selects the path for the next
+ * packet among the candidates that are authorized by both pacing and
+ * congestion control. The select function returns the index of the
+ * selected path in the candidate list, or -1 to use the default selection.
+ * If redundant_packet_max is not zero, 1-RTT packets up to that size are
+ * also repeated on another available path.
+ * If no scheduler is set, the default is to select the path that was used
+ * least recently.
+ */
+typedef int (*picoquic_path_scheduler_select)(picoquic_cnx_t* cnx,
+    picoquic_path_t** candidates, int nb_candidates, uint64_t current_time);
+
+typedef struct st_picoquic_path_scheduler_t {
+    char const* path_scheduler_id;
+    picoquic_path_scheduler_select select_path;
+    size_t redundant_packet_max;
+} picoquic_path_scheduler_t;
+
+#define PICOQUIC_PATH_SCHEDULER_CANDIDATES_MAX 16
+#define PICOQUIC_REDUNDANT_PACKET_MAX 256
+
+/* Send on the path with the lowest smoothed RTT */
+extern picoquic_path_scheduler_t const* picoquic_lowest_rtt_scheduler;
+/* Spread the load in proportion of the estimated capacity of each path */
+extern picoquic_path_scheduler_t const* picoquic_capacity_scheduler;
+/* Lowest RTT, plus repeat of small packets on a second path */
+extern picoquic_path_scheduler_t const* picoquic_redundant_scheduler;
+
+picoquic_path_scheduler_t const* picoquic_get_path_scheduler(char const* scheduler_id);
+void picoquic_set_default_path_scheduler(picoquic_quic_t* quic, picoquic_path_scheduler_t const* scheduler);
+void picoquic_set_path_scheduler(picoquic_cnx_t* cnx, picoquic_path_scheduler_t const* scheduler);
+
+/* Congestion control snapshots. When a connection is handed off to another
+ * server, the congestion control state of a path can be exported on the
+ * old server and imported on the new one, instead of restarting from the
+ * initial window. The snapshot carries the RTT estimates and the congestion
+ * window of the path, followed by the algorithm specific state. It can only
+ * be imported in a path that uses the same algorithm, otherwise
+ * PICOQUIC_ERROR_CC_SNAPSHOT_MISMATCH is returned.
+ * PICOQUIC_CC_SNAPSHOT_MAX is large enough for all the built-in algorithms.
+ */
+#define PICOQUIC_CC_SNAPSHOT_MAX 256
+int picoquic_export_path_cc_state(picoquic_cnx_t* cnx, uint64_t unique_path_id,
+    uint8_t* bytes, size_t bytes_max, size_t* length, uint64_t current_time);
+int picoquic_import_path_cc_state(picoquic_cnx_t* cnx, uint64_t unique_path_id,
+    const uint8_t* bytes, size_t length, uint64_t current_time);
+
+/* Connection handoff between server processes. An established server
+ * connection is exported on the old server, and imported on a new server
+ * that receives the packets of the connection, e.g., after a restart behind
+ * a load balancer routing on the connection IDs. The snapshot carries the
+ * application keys, the connection IDs, the flow control and stream states,
+ * the stream data that was not acknowledged yet, and the state of the path,
+ * including the congestion control snapshot. Stream data that was in flight
+ * at the time of the export is sent again by the new server.
+ *
+ * Both servers must use the same CID generation scheme and the same reset
+ * seed, and the same certificate and ALPN. The export fails with
+ * PICOQUIC_ERROR_CNX_NOT_EXPORTABLE unless the connection is in the ready
+ * state, the handshake done was acked, the key phase was never updated,
+ * and the connection uses a single path, no FEC, no direct receive or
+ * reassembly ring, no deadlines, and no stream reset or stop sending in
+ * progress. Unacknowledged stream data can only be exported if it is
+ * retained, see picoquic_set_stream_repeat_from_queue_policy; the export can
+ * be retried once it is acked.
+ *
+ * Queued datagrams and application contexts are not carried: after
+ * the import, the connection uses the default callback of the new server,
+ * and the application restores its stream contexts with
+ * picoquic_set_app_stream_ctx. The old server should delete its copy with
+ * picoquic_delete_cnx, without closing it. The callback of that copy still
+ * receives picoquic_callback_close, unless it is first reset with
+ * picoquic_set_callback(cnx, NULL, NULL).
+ */
+int picoquic_export_cnx(picoquic_cnx_t* cnx, uint8_t* bytes, size_t bytes_max, size_t* length, uint64_t current_time);
+int picoquic_import_cnx(picoquic_quic_t* quic, const uint8_t* bytes, size_t length, uint64_t current_time,
+    picoquic_cnx_t** p_cnx);
+
 /* The experimental API 'picoquic_set_priority_limit_for_bypass' 
 * instruct the stack to send the high priority streams or datagrams
 * immediately, even if congestion control would normally prevent it.
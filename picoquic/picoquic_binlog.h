@@ -28,6 +28,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include "picoquic_internal.h"
+#include "picoquic_set_binlog.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -113,6 +114,42 @@ int picoquic_set_binlog(picoquic_quic_t* quic, char const* binlog_dir);
 /* Enable binary logs, e.g. if autoqlog is requests */
 void picoquic_enable_binlog(picoquic_quic_t* quic);
 
+/* Binary log file versions. Version 2 stores the chunks in compressed
+ * blocks, see binlog_block.c and picoquic_set_binlog_compression. */
+#define PICOQUIC_BINLOG_VERSION 0x01
+#define PICOQUIC_BINLOG_VERSION_BLOCKS 0x02
+
+#define PICOQUIC_BINLOG_BLOCK_MAX_CIDS 8
+#define PICOQUIC_BINLOG_BLOCK_RAW_MAX 0x1000000
+
+typedef enum {
+    picoquic_binlog_codec_none = 0,
+    picoquic_binlog_codec_zlib = 1,
+    picoquic_binlog_codec_zstd = 2
+} picoquic_binlog_codec_enum;
+
+typedef struct st_picoquic_binlog_block_header_t {
+    size_t block_length; /* Including the 32 bits length field */
+    size_t header_length; /* Offset of the payload in the block */
+    picoquic_binlog_codec_enum codec;
+    size_t raw_length;
+    uint64_t first_time;
+    uint64_t last_time;
+    int is_cid_list_overflow; /* The CID list is not present, the block may contain any CID */
+    size_t nb_cids;
+    picoquic_connection_id_t cid[PICOQUIC_BINLOG_BLOCK_MAX_CIDS];
+} picoquic_binlog_block_header_t;
+
+/* Codec used when writing blocks, depends on the libraries found by the build */
+picoquic_binlog_codec_enum picoquic_binlog_block_codec();
+/* Compress a series of chunks and write them as one block */
+int picoquic_binlog_block_write(FILE* f, const uint8_t* raw, size_t raw_length);
+/* Parse the block header at the start of bytes, with length bytes available */
+int picoquic_binlog_block_parse(const uint8_t* bytes, size_t length, picoquic_binlog_block_header_t* header);
+int picoquic_binlog_block_has_cid(const picoquic_binlog_block_header_t* header, const picoquic_connection_id_t* cid);
+/* Decompress the block payload into raw, which must hold header->raw_length bytes */
+int picoquic_binlog_block_decode(const picoquic_binlog_block_header_t* header, const uint8_t* block, uint8_t* raw);
+
 #ifdef __cplusplus
 }
 #endif
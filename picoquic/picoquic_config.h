@@ -78,6 +78,11 @@ typedef enum {
     picoquic_option_ECH_server,
     picoquic_option_ECH_client,
     picoquic_option_ECH_init,
+    picoquic_option_Packet_Pool,
+    picoquic_option_Data_Node_Pool,
+    picoquic_option_Recv_Batch,
+    picoquic_option_Send_Batch,
+    picoquic_option_Path_Target,
     picoquic_option_HELP
 }  picoquic_option_enum_t;
 
@@ -107,6 +112,7 @@ typedef struct st_picoquic_quic_config_t {
     int bdp_frame_option;
     uint64_t cwin_max;
     int address_discovery_mode;
+    picoquic_tuning_t tuning; /* pool sizes and batch limits, zero means default */
     /* TODO: control other extensions, e.g. time stamp, ack delay */
     /* Common flags */
     unsigned int initial_random;
@@ -161,6 +167,16 @@ int picoquic_config_command_line(int opt, int* p_optind, int argc, char const**
 * and named option (e.g. --disable_block)
  */
 int picoquic_config_command_line_ex(char const* opt_string, int* p_optind, int argc, char const** argv, char const* optarg, picoquic_quic_config_t* config);
+/* picoquic_config_check_option_letters:
+* return -1 if one of the application's own getopt letters is also a picoquic option letter
+ */
+int picoquic_config_check_option_letters(char const* app_letters);
+/* picoquic_config_long_options:
+* apply the named options (e.g. --packet_pool 4096) found in argv and remove them,
+* so that the remaining arguments can be parsed with getopt. Some options are
+* only available in that form.
+ */
+int picoquic_config_long_options(int* p_argc, char** argv, picoquic_quic_config_t* config);
 
 #if 0
 /* It does not seem anyone uses this, and it is not tested */
@@ -173,6 +189,14 @@ picoquic_quic_t* picoquic_create_and_configure(picoquic_quic_config_t* config,
     uint64_t current_time,
     uint64_t* p_simulated_time);
 
+/* Create a QUIC group of nb_shards contexts, see picoquic_create_quic_group,
+ * and apply the configuration to each of them. */
+picoquic_quic_group_t* picoquic_create_and_configure_group(int nb_shards, picoquic_quic_config_t* config,
+    picoquic_stream_data_cb_fn default_callback_fn,
+    void* default_callback_ctx,
+    uint64_t current_time,
+    uint64_t* p_simulated_time);
+
 void picoquic_config_init(picoquic_quic_config_t* config);
 void picoquic_config_clear(picoquic_quic_config_t* config);
 
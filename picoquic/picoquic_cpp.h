@@ -0,0 +1,383 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOQUIC_CPP_H
+#define PICOQUIC_CPP_H
+
+/* Header only C++ layer over picoquic.h.
+ *
+ * The classes are thin wrappers around the C API, and do not add state to
+ * the underlying objects:
+ *
+ * - picoquic::span<T> is a pointer and a length, used to pass stream data
+ *   without copies. It can be built from any contiguous container with
+ *   data() and size() members, including std::vector, std::array or
+ *   std::span.
+ * - picoquic::quic and picoquic::connection own a QUIC context and a
+ *   connection context. They are move only, and free the C object when
+ *   destroyed. picoquic::connection_ref is the non owning variant, used
+ *   in callbacks and for connections created by the stack.
+ * - picoquic::buffer is a move only heap buffer. Moving it into
+ *   connection_ref::add_to_stream_zero_copy hands the bytes to the
+ *   transport, which frees them once sent; no copy is made.
+ * - the callback trampolines are templates over the handler type, so the
+ *   call from the stack reaches the handler without an extra indirection
+ *   or allocation.
+ *
+ * The layer follows the conventions of the C code: errors are reported as
+ * int return codes, not exceptions, and allocation failures result in empty
+ * objects, so it can be used with -fno-exceptions. It only requires C++11.
+ *
+ * A connection is owned by its QUIC context, so a picoquic::connection must
+ * be destroyed or released before the picoquic::quic that created it. The
+ * stack deletes server connections by itself once they are disconnected;
+ * these should only be accessed through connection_ref.
+ */
+
+#ifndef __cplusplus
+#error "picoquic_cpp.h requires a C++ compiler"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+
+namespace picoquic {
+
+/* Contiguous sequence of elements, not owned. */
+template <typename T>
+class span {
+public:
+    span() noexcept : data_(NULL), size_(0) {}
+    span(T* data, size_t size) noexcept : data_(data), size_(size) {}
+    template <typename Container, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<Container>::type, span>::value &&
+        std::is_convertible<decltype(std::declval<Container&>().data()), T*>::value>::type>
+    span(Container& container) noexcept : data_(container.data()), size_(container.size()) {}
+    /* A span of bytes converts to a span of const bytes */
+    template <typename U, typename = typename std::enable_if<
+        std::is_convertible<U*, T*>::value>::type>
+    span(span<U> other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    T* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    T* begin() const noexcept { return data_; }
+    T* end() const noexcept { return data_ + size_; }
+    T& operator[](size_t i) const noexcept { return data_[i]; }
+    /* Sub span, truncated to the available size */
+    span subspan(size_t offset, size_t count = SIZE_MAX) const noexcept
+    {
+        size_t start = (offset < size_) ? offset : size_;
+        size_t length = (count < size_ - start) ? count : size_ - start;
+        return span(data_ + start, length);
+    }
+
+private:
+    T* data_;
+    size_t size_;
+};
+
+typedef span<const uint8_t> byte_span;
+typedef span<uint8_t> mutable_byte_span;
+
+/* Move only heap buffer. The memory is allocated with malloc, so that its
+ * ownership can be passed to C code that calls free.
+ */
+class buffer {
+public:
+    buffer() noexcept : data_(NULL), size_(0) {}
+    /* Allocates size bytes. The buffer is empty if the allocation fails. */
+    explicit buffer(size_t size) noexcept :
+        data_((size == 0) ? NULL : (uint8_t*)malloc(size)), size_((data_ == NULL) ? 0 : size) {}
+    buffer(buffer&& other) noexcept : data_(other.data_), size_(other.size_)
+    {
+        other.data_ = NULL;
+        other.size_ = 0;
+    }
+    buffer& operator=(buffer&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            data_ = other.data_;
+            size_ = other.size_;
+            other.data_ = NULL;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+    buffer(const buffer&) = delete;
+    buffer& operator=(const buffer&) = delete;
+    ~buffer() { reset(); }
+
+    /* Copy of borrowed data, e.g., bytes received in a callback that
+     * must be kept after the callback returns. */
+    static buffer copy_of(byte_span bytes) noexcept
+    {
+        buffer b(bytes.size());
+        if (b.size() > 0) {
+            memcpy(b.data_, bytes.data(), bytes.size());
+        }
+        return b;
+    }
+
+    uint8_t* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    mutable_byte_span bytes() const noexcept { return mutable_byte_span(data_, size_); }
+    /* Reduce the size without reallocating, e.g., after a partial fill */
+    void shrink(size_t size) noexcept
+    {
+        if (size < size_) {
+            size_ = size;
+        }
+    }
+    /* Give up ownership; the caller must free() the returned pointer. */
+    uint8_t* release() noexcept
+    {
+        uint8_t* data = data_;
+        data_ = NULL;
+        size_ = 0;
+        return data;
+    }
+    void reset() noexcept
+    {
+        if (data_ != NULL) {
+            free(data_);
+            data_ = NULL;
+        }
+        size_ = 0;
+    }
+
+    /* Release function passed to picoquic_add_to_stream_zero_copy */
+    static void release_fn(void* release_ctx, const uint8_t* data, size_t length) noexcept
+    {
+        (void)release_ctx;
+        (void)length;
+        free((void*)data);
+    }
+
+private:
+    uint8_t* data_;
+    size_t size_;
+};
+
+/* Callback trampolines.
+ * The handler is called as:
+ *
+ *     int handler(connection_ref cnx, uint64_t stream_id, mutable_byte_span bytes,
+ *         picoquic_call_back_event_t event, void* stream_ctx);
+ *
+ * The bytes are borrowed from the stack, and are only valid during the
+ * call. For picoquic_callback_prepare_to_send, bytes.data() is the context
+ * to pass to provide_stream_data, and bytes.size() is the maximum length.
+ * The handler object is passed as the callback context, and must outlive
+ * the connections that use it.
+ */
+class connection_ref;
+
+template <typename Handler>
+int stream_data_trampoline(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* stream_ctx);
+
+/* Get the buffer in which to write data when handling picoquic_callback_prepare_to_send.
+ * Returns an empty span in case of error.
+ */
+inline mutable_byte_span provide_stream_data(void* context, size_t nb_bytes, bool is_fin, bool is_still_active) noexcept
+{
+    uint8_t* buffer = picoquic_provide_stream_data_buffer(context, nb_bytes, is_fin, is_still_active);
+    return mutable_byte_span(buffer, (buffer == NULL) ? 0 : nb_bytes);
+}
+
+/* Non owning reference to a connection context. */
+class connection_ref {
+public:
+    connection_ref() noexcept : cnx_(NULL) {}
+    explicit connection_ref(picoquic_cnx_t* cnx) noexcept : cnx_(cnx) {}
+
+    picoquic_cnx_t* get() const noexcept { return cnx_; }
+    explicit operator bool() const noexcept { return cnx_ != NULL; }
+
+    picoquic_state_enum state() const noexcept { return picoquic_get_cnx_state(cnx_); }
+    int start_client() const noexcept { return picoquic_start_client_cnx(cnx_); }
+    int close(uint64_t application_reason_code) const noexcept { return picoquic_close(cnx_, application_reason_code); }
+    uint64_t next_local_stream_id(bool is_unidir) const noexcept { return picoquic_get_next_local_stream_id(cnx_, is_unidir); }
+
+    template <typename Handler>
+    void set_callback(Handler* handler) const noexcept
+    {
+        picoquic_set_callback(cnx_, &stream_data_trampoline<Handler>, handler);
+    }
+
+    /* Queue a copy of the data. */
+    int add_to_stream(uint64_t stream_id, byte_span data, bool set_fin, void* app_stream_ctx = NULL) const noexcept
+    {
+        return picoquic_add_to_stream_with_ctx(cnx_, stream_id, data.data(), data.size(), set_fin, app_stream_ctx);
+    }
+
+    /* Hand the buffer to the transport, without copy. On success, the buffer
+     * is left empty and the transport frees the memory once the data is sent,
+     * or if the stream or connection is deleted first. On error, the buffer
+     * is unchanged. */
+    int add_to_stream_zero_copy(uint64_t stream_id, buffer&& data, bool set_fin, void* app_stream_ctx = NULL) const noexcept
+    {
+        int ret = picoquic_add_to_stream_zero_copy(cnx_, stream_id, data.data(), data.size(), set_fin, app_stream_ctx,
+            &buffer::release_fn, NULL);
+        if (ret == 0 && data.size() > 0) {
+            (void)data.release();
+        }
+        return ret;
+    }
+
+    /* Reference to a buffer owned by the application, which must stay valid
+     * until release_fn is called. */
+    int add_to_stream_zero_copy(uint64_t stream_id, byte_span data, bool set_fin, void* app_stream_ctx,
+        picoquic_stream_data_release_fn release_fn, void* release_ctx) const noexcept
+    {
+        return picoquic_add_to_stream_zero_copy(cnx_, stream_id, data.data(), data.size(), set_fin, app_stream_ctx,
+            release_fn, release_ctx);
+    }
+
+    int mark_active_stream(uint64_t stream_id, bool is_active, void* app_stream_ctx = NULL) const noexcept
+    {
+        return picoquic_mark_active_stream(cnx_, stream_id, is_active, app_stream_ctx);
+    }
+
+    int set_app_stream_ctx(uint64_t stream_id, void* app_stream_ctx) const noexcept
+    {
+        return picoquic_set_app_stream_ctx(cnx_, stream_id, app_stream_ctx);
+    }
+
+    int reset_stream(uint64_t stream_id, uint64_t local_stream_error) const noexcept
+    {
+        return picoquic_reset_stream(cnx_, stream_id, local_stream_error);
+    }
+
+protected:
+    picoquic_cnx_t* cnx_;
+};
+
+template <typename Handler>
+int stream_data_trampoline(picoquic_cnx_t* cnx, uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* stream_ctx)
+{
+    return (*static_cast<Handler*>(callback_ctx))(connection_ref(cnx), stream_id,
+        mutable_byte_span(bytes, length), fin_or_event, stream_ctx);
+}
+
+/* Owning connection handle: the connection is deleted when the handle
+ * is destroyed, unless it was released. */
+class connection : public connection_ref {
+public:
+    connection() noexcept {}
+    explicit connection(picoquic_cnx_t* cnx) noexcept : connection_ref(cnx) {}
+    connection(connection&& other) noexcept : connection_ref(other.release()) {}
+    connection& operator=(connection&& other) noexcept
+    {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+    connection(const connection&) = delete;
+    connection& operator=(const connection&) = delete;
+    ~connection() { reset(); }
+
+    picoquic_cnx_t* release() noexcept
+    {
+        picoquic_cnx_t* cnx = cnx_;
+        cnx_ = NULL;
+        return cnx;
+    }
+    void reset(picoquic_cnx_t* cnx = NULL) noexcept
+    {
+        if (cnx_ != NULL) {
+            picoquic_delete_cnx(cnx_);
+        }
+        cnx_ = cnx;
+    }
+};
+
+/* Owning QUIC context handle. */
+class quic {
+public:
+    quic() noexcept : quic_(NULL) {}
+    explicit quic(picoquic_quic_t* q) noexcept : quic_(q) {}
+    quic(quic&& other) noexcept : quic_(other.release()) {}
+    quic& operator=(quic&& other) noexcept
+    {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+    quic(const quic&) = delete;
+    quic& operator=(const quic&) = delete;
+    ~quic() { reset(); }
+
+    picoquic_quic_t* get() const noexcept { return quic_; }
+    explicit operator bool() const noexcept { return quic_ != NULL; }
+    picoquic_quic_t* release() noexcept
+    {
+        picoquic_quic_t* q = quic_;
+        quic_ = NULL;
+        return q;
+    }
+    void reset(picoquic_quic_t* q = NULL) noexcept
+    {
+        if (quic_ != NULL) {
+            picoquic_free(quic_);
+        }
+        quic_ = q;
+    }
+
+    template <typename Handler>
+    void set_default_callback(Handler* handler) const noexcept
+    {
+        picoquic_set_default_callback(quic_, &stream_data_trampoline<Handler>, handler);
+    }
+
+    /* Create a client connection, with the handler as callback. The
+     * connection is empty in case of error. */
+    template <typename Handler>
+    connection create_client_connection(const struct sockaddr* addr_to, uint64_t start_time,
+        uint32_t preferred_version, char const* sni, char const* alpn, Handler* handler) const noexcept
+    {
+        connection cnx(picoquic_create_cnx(quic_, picoquic_null_connection_id, picoquic_null_connection_id,
+            addr_to, start_time, preferred_version, sni, alpn, 1));
+        if (cnx) {
+            cnx.set_callback(handler);
+        }
+        return cnx;
+    }
+
+private:
+    picoquic_quic_t* quic_;
+};
+
+} /* namespace picoquic */
+
+#endif /* PICOQUIC_CPP_H */
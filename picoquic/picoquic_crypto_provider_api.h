@@ -47,6 +47,8 @@ extern "C" {
     typedef ptls_verify_certificate_t* (*picoquic_get_certificate_verifier_t)(char const* cert_root_file_name,
         unsigned int* is_cert_store_not_empty, picoquic_dispose_certificate_verifier_t * free_certificate_verifier_fn);
     typedef int (*picoquic_set_tls_root_certificates_t)(ptls_context_t* ctx, ptls_iovec_t* certs, size_t count);
+    typedef int (*picoquic_verify_sign_t)(void* verify_ctx, uint16_t algo, ptls_iovec_t data, ptls_iovec_t sign);
+    typedef int (*picoquic_get_leaf_sign_verifier_t)(ptls_iovec_t leaf, picoquic_verify_sign_t* verify_sign, void** verify_data);
     typedef int (*picoquic_explain_crypto_error_t)(char const** err_file, int* err_line);
     typedef void (*picoquic_clear_crypto_errors_t)();
     typedef void (*picoquic_set_random_provider_in_ctx_t)(ptls_context_t* ctx);
@@ -64,6 +66,10 @@ extern "C" {
         picoquic_dispose_certificate_verifier_t dispose_certificate_verifier_fn,
         picoquic_set_tls_root_certificates_t set_tls_root_certificates_fn);
 
+    /* Optional: verify the handshake signature with the key of a leaf certificate
+     * that was already validated, used by the certificate verification cache. */
+    void picoquic_register_leaf_sign_verifier_fn(picoquic_get_leaf_sign_verifier_t get_leaf_sign_verifier_fn);
+
     void picoquic_register_explain_crypto_error_fn(picoquic_explain_crypto_error_t explain_crypto_error_fn,
         picoquic_clear_crypto_errors_t clear_crypto_errors_fn);
 
@@ -96,6 +102,7 @@ extern "C" {
     extern picoquic_get_certificate_verifier_t picoquic_get_certificate_verifier_fn;
     extern picoquic_dispose_certificate_verifier_t picoquic_dispose_certificate_verifier_fn;
     extern picoquic_set_tls_root_certificates_t picoquic_set_tls_root_certificates_fn;
+    extern picoquic_get_leaf_sign_verifier_t picoquic_get_leaf_sign_verifier_fn;
     extern picoquic_explain_crypto_error_t picoquic_explain_crypto_error_fn;
     extern picoquic_clear_crypto_errors_t picoquic_clear_crypto_errors_fn;
     extern picoquic_crypto_random_provider_t picoquic_crypto_random_provider_fn;
@@ -124,6 +131,7 @@ extern "C" {
         size_t ext_data_size;
         uint8_t app_secret_enc[PTLS_MAX_DIGEST_SIZE];
         uint8_t app_secret_dec[PTLS_MAX_DIGEST_SIZE];
+        ptls_cipher_suite_t* imported_cipher; /* Set if the application secrets were imported, see picoquic_import_app_traffic_secrets */
     } picoquic_tls_ctx_t;
 
 #ifdef __cplusplus
@@ -28,6 +28,8 @@
 
 #include "picohash.h"
 #include "picosplay.h"
+#include "picowheel.h"
+#include "picoradix.h"
 #include "picoquic.h"
 #include "picoquic_utils.h"
 
@@ -35,10 +37,8 @@
 extern "C" {
 #endif
 
-#ifndef PICOQUIC_MAX_PACKET_SIZE
-#define PICOQUIC_MAX_PACKET_SIZE 1536
-#endif
 #define PICOQUIC_MIN_SEGMENT_SIZE 256
+#define PICOQUIC_REBINDING_SEND_MIN 64 /* Smallest packet sent while a rebinding is amplification limited */
 #define PICOQUIC_ENFORCED_INITIAL_MTU 1200
 #define PICOQUIC_ENFORCED_INITIAL_CID_LENGTH 8
 #define PICOQUIC_PRACTICAL_MAX_MTU 1440
@@ -48,7 +48,10 @@ extern "C" {
 #define PICOQUIC_DEFAULT_0RTT_WINDOW (10*PICOQUIC_ENFORCED_INITIAL_MTU)
 #define PICOQUIC_NB_PATH_TARGET 8
 #define PICOQUIC_NB_PATH_DEFAULT 2
+#define PICOQUIC_PATH_INDEX_THRESHOLD 4
 #define PICOQUIC_MAX_PACKETS_IN_POOL 0x2000
+#define PICOQUIC_SMALL_PACKET_SIZE 256
+#define PICOQUIC_DEFAULT_OBJECTS_IN_POOL 64
 #define PICOQUIC_STORED_IP_MAX 16
 
 #define PICOQUIC_INITIAL_RTT 250000ull /* 250 ms */
@@ -63,11 +66,17 @@ extern "C" {
 #define PICOQUIC_ACK_DELAY_MIN 1000ull /* 1 ms */
 #define PICOQUIC_ACK_DELAY_MIN_MAX_VALUE 0xFFFFFFull /* max value that can be negotiated by peers */
 #define PICOQUIC_RACK_DELAY 10000ull /* 10 ms */
+#define PICOQUIC_REORDER_PACKET_THRESHOLD 3 /* Default packet threshold for loss detection */
+#define PICOQUIC_REORDER_PACKET_THRESHOLD_MAX 32
+#define PICOQUIC_REORDER_WINDOW_MULT_MAX 8
+#define PICOQUIC_REORDER_WINDOW_PERSIST 16 /* Loss episodes before resetting the reordering window */
 #define PICOQUIC_MAX_ACK_DELAY_MAX_MS 0x4000ull /* 2<14 ms */
 #define PICOQUIC_TOKEN_DELAY_LONG (24*60*60*1000000ull) /* 24 hours */
 #define PICOQUIC_TOKEN_DELAY_SHORT (2*60*1000000ull) /* 2 minutes */
 #define PICOQUIC_CID_REFRESH_DELAY (5*1000000ull) /* if idle for 5 seconds, refresh the CID */
 #define PICOQUIC_MTU_LOSS_THRESHOLD 10 /* if threshold of full MTU packetlost, reset MTU */
+#define PICOQUIC_MTU_PROBE_STEP 32 /* stop searching for the MTU when closer than that */
+#define PICOQUIC_MTU_JUMBO_PROBE_STEP 256 /* stop searching for a jumbo MTU when closer than that */
 
 #define PICOQUIC_BANDWIDTH_ESTIMATE_MAX 10000000000ull /* 10 GB per second */
 #define PICOQUIC_BANDWIDTH_TIME_INTERVAL_MIN 1000
@@ -79,12 +88,15 @@ extern "C" {
 #define PICOQUIC_MINRTT_THRESHOLD 128 /* RTT MIN value under which congestion control should not be driven by RTT changes */
 
 #define PICOQUIC_SPURIOUS_RETRANSMIT_DELAY_MAX 1000000ull /* one second */
+#define PICOQUIC_PACKET_INDEX_MIN_SLOTS 64
+#define PICOQUIC_PACKET_INDEX_MAX_SLOTS 0x40000
 
 #define PICOQUIC_MICROSEC_SILENCE_MAX 120000000ull /* 120 seconds for now */
 #define PICOQUIC_MICROSEC_HANDSHAKE_MAX 30000000ull /* 30 seconds for now */
 #define PICOQUIC_MICROSEC_WAIT_MAX 10000000ull /* 10 seconds for now */
 
 #define PICOQUIC_MICROSEC_STATELESS_RESET_INTERVAL_DEFAULT 100000ull /* max 10 stateless reset by second by default */
+#define PICOQUIC_STATELESS_RING_SIZE_DEFAULT 32
 
 #define PICOQUIC_CWIN_INITIAL (10 * PICOQUIC_MAX_PACKET_SIZE)
 #define PICOQUIC_CWIN_MINIMUM (2 * PICOQUIC_MAX_PACKET_SIZE)
@@ -115,9 +127,14 @@ extern "C" {
 #define PICOQUIC_CC_ALGO_NUMBER_BBR 5
 #define PICOQUIC_CC_ALGO_NUMBER_PRAGUE 6
 #define PICOQUIC_CC_ALGO_NUMBER_BBR1 7
+#define PICOQUIC_CC_ALGO_NUMBER_LIA 8
+#define PICOQUIC_CC_ALGO_NUMBER_OLIA 9
+#define PICOQUIC_CC_ALGO_NUMBER_BALIA 10
 
 #define PICOQUIC_MAX_ACK_RANGE_REPEAT 4
 #define PICOQUIC_MIN_ACK_RANGE_REPEAT 2
+#define PICOQUIC_MAX_ACK_RANGE_SCAN 256
+#define PICOQUIC_MAX_ACK_RANGES_TRACKED 512
 
 #define PICOQUIC_DEFAULT_HOLE_PERIOD 256
 
@@ -167,7 +184,9 @@ typedef enum {
     picoquic_frame_type_paths_blocked = 0x15228c0d,
     picoquic_frame_type_path_cid_blocked = 0x15228c0e,
     picoquic_frame_type_observed_address_v4 = 0x9f81a6,
-    picoquic_frame_type_observed_address_v6 = 0x9f81a7
+    picoquic_frame_type_observed_address_v6 = 0x9f81a7,
+    picoquic_frame_type_fec_repair = 0xfec0,
+    picoquic_frame_type_stream_metadata = 0x3f5e /* Internal, only found in packets queued for retransmit */
 } picoquic_frame_type_enum_t;
 
 /* PMTU discovery requirement status */
@@ -242,6 +261,8 @@ typedef struct st_picoquic_version_parameters_t {
     uint32_t* upgrade_from;
 } picoquic_version_parameters_t;
 
+#define PICOQUIC_NB_SUPPORTED_VERSIONS_MAX 16
+
 extern const picoquic_version_parameters_t picoquic_supported_versions[];
 extern const size_t picoquic_nb_supported_versions;
 
@@ -352,23 +373,42 @@ typedef struct st_picoquic_stateless_packet_t {
     uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
 } picoquic_stateless_packet_t;
 
-/* Handling of stateless packets */
+/* Handling of stateless packets.
+ * Packets created by picoquic_create_stateless_packet are taken from
+ * the stateless ring of the QUIC context, if it is configured. The slot
+ * is only reserved until the packet is queued. Packets returned by
+ * picoquic_dequeue_stateless_packet must be released by calling
+ * picoquic_delete_stateless_packet before the next dequeue.
+ * Packets stashed by connections, such as the "sooner" packets, are
+ * allocated separately since they are not part of the queue.
+ */
 picoquic_stateless_packet_t* picoquic_create_stateless_packet(picoquic_quic_t* quic);
 void picoquic_queue_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp);
 picoquic_stateless_packet_t* picoquic_dequeue_stateless_packet(picoquic_quic_t* quic);
-void picoquic_delete_stateless_packet(picoquic_stateless_packet_t* sp);
-
-/* Data structure used to hold chunk of stream data before in sequence delivery */
+void picoquic_delete_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp);
+int picoquic_has_pending_stateless_packet(picoquic_quic_t* quic);
+
+/* Data structure used to hold chunk of stream data before in sequence delivery.
+ * Nodes come in three size classes, like packets: small nodes are allocated
+ * with only PICOQUIC_SMALL_PACKET_SIZE bytes of "data", full size nodes
+ * with PICOQUIC_MAX_PACKET_SIZE, jumbo nodes with PICOQUIC_MAX_JUMBO_PACKET_SIZE.
+ * The size of "data" is in "data_max". */
 typedef struct st_picoquic_stream_data_node_t {
     picosplay_node_t stream_data_node;
     picoquic_quic_t* quic;
+    picoquic_cnx_t* cnx; /* Connection charged for the node, NULL if not charged */
     struct st_picoquic_stream_data_node_t* next_stream_data;
     uint64_t offset;  /* Stream offset of the first octet in "bytes" */
     size_t length;    /* Number of octets in "bytes" */
+    size_t data_max;
     const uint8_t* bytes;
-    uint8_t data[PICOQUIC_MAX_PACKET_SIZE];
+    struct st_picoquic_stream_data_node_t* buffer_node; /* If not NULL, "bytes" points into that node's data */
+    int nb_refs; /* Number of views or holds on "data", in addition to the node owner */
+    uint8_t data[PICOQUIC_MAX_JUMBO_PACKET_SIZE];
 } picoquic_stream_data_node_t;
 
+#define PICOQUIC_DATA_NODE_ALLOC_SIZE(data_max) (offsetof(picoquic_stream_data_node_t, data) + (data_max))
+
 /* Data structure used to hold chunk of stream data queued by application */
 typedef struct st_picoquic_stream_queue_node_t {
     picoquic_quic_t* quic;
@@ -376,8 +416,19 @@ typedef struct st_picoquic_stream_queue_node_t {
     uint64_t offset;  /* Stream offset of the first octet in "bytes" */
     size_t length;    /* Number of octets in "bytes" */
     uint8_t* bytes;
+    picoquic_stream_data_release_fn release_fn; /* If not NULL, "bytes" is owned by the application */
+    void* release_ctx;
+    uint64_t stream_offset; /* Stream offset of bytes[0], only set once the node is retained after sending */
 } picoquic_stream_queue_node_t;
 
+/* Bytes copied by the transport are allocated in the same block as the queue node */
+#define PICOQUIC_STREAM_QUEUE_NODE_INLINE_BYTES(n) ((uint8_t*)((n) + 1))
+/* Memory charged for a queue node: the bytes are not counted if they belong to the application */
+#define PICOQUIC_STREAM_QUEUE_NODE_CHARGE(n) (sizeof(picoquic_stream_queue_node_t) + (((n)->release_fn == NULL)?(n)->length:0))
+/* Coalesced writes are queued for sending once they reach this size, see picoquic_cork_stream */
+#define PICOQUIC_CORK_THRESHOLD 16384
+#define PICOQUIC_CORK_INITIAL_SIZE 512
+
 /*
  * The simple packet structure is used to store packets that
  * have been sent but are not yet acknowledged.
@@ -389,7 +440,9 @@ typedef struct st_picoquic_packet_t {
     struct st_picoquic_packet_t* packet_next;
     struct st_picoquic_packet_t* packet_previous;
     struct st_picoquic_path_t* send_path;
-    picosplay_node_t queue_data_repeat_node;
+    struct st_picoquic_packet_t* data_repeat_next; /* links in the data repeat queue */
+    struct st_picoquic_packet_t* data_repeat_previous;
+    struct st_picoquic_packet_t* data_repeat_bucket_last; /* last packet of the same priority, if first of that priority */
     uint64_t sequence_number;
     uint64_t send_time;
     uint64_t delivered_prior;
@@ -400,7 +453,7 @@ typedef struct st_picoquic_packet_t {
     size_t data_repeat_frame;
     size_t data_repeat_index;
 
-    /* Handling of data repeat queue requires sorting by priority,
+    /* The data repeat queue is sorted by priority, then
     * stream_id, stream_offset, data_length
     */
     uint64_t data_repeat_priority;
@@ -411,6 +464,7 @@ typedef struct st_picoquic_packet_t {
     size_t length;
     size_t checksum_overhead;
     size_t offset;
+    size_t bytes_max; /* Size of "bytes", per size class */
     picoquic_packet_type_enum ptype;
     picoquic_packet_context_enum pc;
     unsigned int is_evaluated : 1;
@@ -421,30 +475,235 @@ typedef struct st_picoquic_packet_t {
     unsigned int delivered_app_limited : 1;
     unsigned int sent_cwin_limited : 1;
     unsigned int is_preemptive_repeat : 1;
+    unsigned int is_ce_marked : 1; /* A CE mark reported by the peer was attributed to this packet */
     unsigned int was_preemptively_repeated : 1;
     unsigned int is_queued_to_path : 1;
     unsigned int is_queued_for_retransmit : 1;
     unsigned int is_queued_for_spurious_detection : 1;
     unsigned int is_queued_for_data_repeat : 1;
+    unsigned int is_data_repeat_hint : 1; /* Packet is the data repeat hint of its stream */
+    unsigned int is_charged_to_cnx : 1;
+    unsigned int is_fec_protected : 1;
+    size_t stripped_length; /* Stream data removed from "bytes" after sending, see picoquic_strip_retained_stream_data */
 
-    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t bytes[PICOQUIC_MAX_JUMBO_PACKET_SIZE];
 } picoquic_packet_t;
 
+/* Packets come in three size classes. Most ACK-only and control packets fit
+ * in a small packet, PICOQUIC_SMALL_PACKET_SIZE bytes. Full size packets hold
+ * up to PICOQUIC_MAX_PACKET_SIZE bytes. Jumbo packets, up to
+ * PICOQUIC_MAX_JUMBO_PACKET_SIZE bytes, are only used when "mtu_max" allows
+ * paths with a larger MTU. Each class has its own pool. Small and full size
+ * packets are allocated with a truncated "bytes" array, so code must not
+ * access bytes beyond "bytes_max", nor copy packets by structure assignment.
+ */
+#define PICOQUIC_PACKET_ALLOC_SIZE(bytes_max) (offsetof(picoquic_packet_t, bytes) + (bytes_max))
+/* Length of the packet as sent, used for congestion control and MTU accounting.
+ * It differs from "length" if the stream data was stripped from the queued packet. */
+#define PICOQUIC_PACKET_SENT_LENGTH(p) ((p)->length + (p)->stripped_length)
+#define PICOQUIC_SIZE_CLASS(length) (((length) <= PICOQUIC_SMALL_PACKET_SIZE) ? PICOQUIC_SMALL_PACKET_SIZE : \
+    (((length) <= PICOQUIC_MAX_PACKET_SIZE) ? PICOQUIC_MAX_PACKET_SIZE : PICOQUIC_MAX_JUMBO_PACKET_SIZE))
+
 picoquic_packet_t* picoquic_create_packet(picoquic_quic_t* quic);
+picoquic_packet_t* picoquic_create_packet_ex(picoquic_quic_t* quic, size_t length);
 void picoquic_recycle_packet(picoquic_quic_t* quic, picoquic_packet_t* packet);
+void picoquic_recycle_queued_packet(picoquic_cnx_t* cnx, picoquic_packet_t* packet);
+picoquic_packet_t* picoquic_compact_queued_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_t* packet);
+
+/* Object pools, see picoquic_set_object_allocator */
+void picoquic_object_pools_init(picoquic_quic_t* quic);
+void picoquic_object_pools_release(picoquic_quic_t* quic);
+void* picoquic_object_alloc(picoquic_quic_t* quic, picoquic_object_type_enum object_type);
+void picoquic_object_free(picoquic_quic_t* quic, picoquic_object_type_enum object_type, void* object);
+struct st_picoquic_misc_frame_header_t* picoquic_misc_frame_alloc(picoquic_quic_t* quic, size_t length);
+void picoquic_misc_frame_free(picoquic_quic_t* quic, struct st_picoquic_misc_frame_header_t* frame);
+
+/* Per iteration limits of the packet loops, see picoquic_set_tuning */
+size_t picoquic_get_packet_loop_recv_max(picoquic_quic_t* quic);
+size_t picoquic_get_packet_loop_send_max(picoquic_quic_t* quic);
+
+/* Slabs of packets and data nodes allocated by picoquic_prewarm_pools.
+ * Objects carved from a slab stay in their pool when recycled, and the
+ * slab is released as a whole when the QUIC context is deleted.
+ */
+typedef struct st_picoquic_prewarm_slab_t {
+    struct st_picoquic_prewarm_slab_t* next_slab;
+    uint8_t* base;
+    size_t size;
+    int is_mapped;
+} picoquic_prewarm_slab_t;
+
+int picoquic_is_prewarmed(picoquic_quic_t* quic, const void* object);
+void picoquic_prewarm_slabs_release(picoquic_quic_t* quic);
 size_t picoquic_pad_to_policy(picoquic_cnx_t* cnx, uint8_t* bytes, size_t length, uint32_t max_length);
 
 /* Definition of the token register used to prevent repeated usage of
  * the same new token, retry token, or session ticket.
+ *
+ * The register is a hash table split in shards, each shard holding a fixed
+ * number of slots allocated on first use. A token is looked up in a short
+ * probe window, so the cost per packet is constant. Each entry carries the
+ * expiry time of the token: entries older than the "expiry floor" set by
+ * picoquic_registered_token_clear are free, and are reclaimed in place when
+ * a new token lands in the same window. If the window is full of live entries,
+ * the entry closest to expiry is evicted and the eviction is counted.
  */
 
+#define PICOQUIC_TOKEN_REGISTRY_SHARDS 16
+#define PICOQUIC_TOKEN_REGISTRY_SHARD_SLOTS 1024
+#define PICOQUIC_TOKEN_REGISTRY_PROBE 8
+
 typedef struct st_picoquic_registered_token_t {
-    picosplay_node_t registered_token_node;
     uint64_t token_time;
     uint64_t token_hash; /* The last 8 bytes of the token, normally taken from AEAD checksum */
-    int count;
+    int count; /* 0 if the slot is empty */
 } picoquic_registered_token_t;
 
+typedef struct st_picoquic_token_registry_t {
+    uint64_t expiry_floor; /* Tokens expiring before that time are ignored */
+    uint64_t nb_evicted;
+    picoquic_registered_token_t* shard[PICOQUIC_TOKEN_REGISTRY_SHARDS];
+} picoquic_token_registry_t;
+
+/* Cuckoo filter over the registered stateless reset secrets, checked
+ * before looking up table_cnx_by_secret, see reset_filter.c.
+ */
+#define PICOQUIC_RESET_FILTER_BUCKET_SIZE 4
+
+typedef struct st_picoquic_reset_filter_t {
+    uint16_t* fingerprints; /* (bucket_mask + 1) * PICOQUIC_RESET_FILTER_BUCKET_SIZE, allocated on first use */
+    size_t bucket_mask;
+    size_t nb_entries;
+    uint64_t nb_rejected; /* Packets for which the full check was skipped */
+    int is_disabled; /* Set if the filter could not be grown, all packets are checked */
+} picoquic_reset_filter_t;
+
+/* Rate limiter of Initial packets per source prefix. Each slot is a token
+ * bucket for one /24 IPv4 or /64 IPv6 prefix. Slots are direct mapped by
+ * hash; a new prefix replaces the previous one in its slot.
+ */
+#define PICOQUIC_INITIAL_RATE_SLOTS 4096
+
+typedef struct st_picoquic_initial_rate_slot_t {
+    uint64_t prefix_hash;
+    uint64_t last_time;
+    uint64_t credit; /* In packets times one million */
+} picoquic_initial_rate_slot_t;
+
+typedef struct st_picoquic_initial_rate_limiter_t {
+    uint64_t packets_per_second;
+    uint64_t burst;
+    uint64_t nb_limited;
+    picoquic_initial_rate_slot_t slot[PICOQUIC_INITIAL_RATE_SLOTS];
+} picoquic_initial_rate_limiter_t;
+
+int picoquic_initial_rate_check(picoquic_quic_t* quic, const struct sockaddr* addr_from, uint64_t current_time);
+
+/* Admission control, see admission.c. Queue class 0 holds the packets
+ * with a valid token, class 1 the others. */
+typedef struct st_picoquic_admission_entry_t {
+    struct st_picoquic_admission_entry_t* next;
+    uint64_t arrival_time;
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_to;
+    int if_index_to;
+    unsigned char received_ecn;
+    size_t length;
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+} picoquic_admission_entry_t;
+
+typedef struct st_picoquic_admission_ctx_t {
+    size_t max_queued;
+    size_t nb_queued;
+    uint64_t handshakes_per_second;
+    uint64_t burst;
+    uint64_t max_queue_delay;
+    uint64_t credit; /* In handshakes times one million */
+    uint64_t last_time;
+    picoquic_admission_entry_t* first[2];
+    picoquic_admission_entry_t* last[2];
+    int is_processing; /* Queued packets are being replayed */
+    int is_pending_priority; /* Class of the packet deferred by the last check */
+    picoquic_admission_stats_t stats;
+} picoquic_admission_ctx_t;
+
+int picoquic_admission_check(picoquic_quic_t* quic, int is_priority, uint64_t current_time);
+int picoquic_admission_is_replay(picoquic_quic_t* quic);
+void picoquic_admission_queue(picoquic_quic_t* quic, const uint8_t* bytes, size_t length,
+    const struct sockaddr* addr_from, const struct sockaddr* addr_to, int if_index_to,
+    unsigned char received_ecn, uint64_t current_time);
+uint64_t picoquic_admission_next_time(picoquic_quic_t* quic, uint64_t current_time);
+int picoquic_admission_process(picoquic_quic_t* quic, uint64_t current_time);
+void picoquic_admission_free(picoquic_quic_t* quic);
+
+/* Compact records of closed connections, see tombstone.c. The record,
+ * its connection ID entries and the close datagram share one allocation. */
+typedef struct st_picoquic_tombstone_cid_t {
+    picohash_item hash_item;
+    picoquic_connection_id_t cnx_id;
+    struct st_picoquic_tombstone_t* tombstone;
+} picoquic_tombstone_cid_t;
+
+typedef struct st_picoquic_tombstone_t {
+    struct st_picoquic_tombstone_t* next;
+    struct st_picoquic_tombstone_t* previous;
+    uint64_t expiry_time;
+    uint64_t next_send_time;
+    uint64_t resend_interval;
+    picoquic_connection_id_t initial_cnxid;
+    int is_draining;
+    size_t nb_cid;
+    picoquic_tombstone_cid_t* cid;
+    size_t close_length;
+    uint8_t* close_bytes;
+} picoquic_tombstone_t;
+
+typedef struct st_picoquic_tombstone_ctx_t {
+    picohash_table* table;
+    picoquic_tombstone_t* first; /* oldest record */
+    picoquic_tombstone_t* last;
+    size_t max_records;
+    picoquic_compact_closing_stats_t stats;
+} picoquic_tombstone_ctx_t;
+
+int picoquic_tombstone_create(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length, uint64_t current_time);
+int picoquic_tombstone_incoming(picoquic_quic_t* quic, const picoquic_connection_id_t* dest_cnx_id, size_t length,
+    const struct sockaddr* addr_from, const struct sockaddr* addr_to, int if_index_to, uint64_t current_time);
+void picoquic_tombstone_purge(picoquic_quic_t* quic, uint64_t current_time);
+void picoquic_tombstone_free(picoquic_quic_t* quic);
+
+/* Egress scheduler, see egress.c. Connections that are due to send are
+ * moved from the wake list to the ready queue of their group; the scheduler
+ * then picks the group that shall send next. */
+typedef struct st_picoquic_egress_group_t {
+    picoquic_cnx_t* first_ready;
+    picoquic_cnx_t* last_ready;
+    char* alpn; /* If not NULL, connections with that ALPN are in this group */
+    int is_priority;
+    uint64_t quantum; /* bytes added to the deficit at each round */
+    int64_t deficit;
+    uint64_t rate; /* bytes per second, zero if not limited */
+    uint64_t burst;
+    int64_t credit; /* bytes times one million, can be negative after a large train */
+    uint64_t last_time;
+    picoquic_egress_group_stats_t stats;
+} picoquic_egress_group_t;
+
+typedef struct st_picoquic_egress_ctx_t {
+    picoquic_egress_group_fn group_fn;
+    void* group_ctx;
+    int nb_groups;
+    int drr_current;
+    picoquic_egress_group_t group[PICOQUIC_EGRESS_MAX_GROUPS];
+} picoquic_egress_ctx_t;
+
+picoquic_cnx_t* picoquic_egress_select(picoquic_quic_t* quic, uint64_t current_time);
+void picoquic_egress_charge(picoquic_quic_t* quic, int group_id, size_t length, uint64_t current_time);
+void picoquic_egress_unqueue(picoquic_cnx_t* cnx);
+uint64_t picoquic_egress_next_time(picoquic_quic_t* quic, uint64_t current_time);
+void picoquic_egress_free(picoquic_quic_t* quic);
+void picoquic_remove_cnx_from_wake_list(picoquic_cnx_t* cnx);
+
 /*
  * Definition of the session ticket store and connection token
  * store that can be associated with a
@@ -467,6 +726,9 @@ typedef enum {
 
 typedef struct st_picoquic_stored_ticket_t {
     struct st_picoquic_stored_ticket_t* next_ticket;
+    struct st_picoquic_stored_ticket_t* previous_ticket;
+    struct st_picoquic_stored_ticket_t* next_in_bin;
+    uint64_t index_hash;
     char* sni;
     char* alpn;
     uint8_t* ip_addr;
@@ -505,9 +767,32 @@ int picoquic_load_tickets(picoquic_quic_t* quic, char const* ticket_file_name);
 void picoquic_free_tickets(picoquic_stored_ticket_t** pp_first_ticket);
 void picoquic_seed_ticket(picoquic_cnx_t* cnx, picoquic_path_t* path_x);
 
+/* Hash index of the stored tickets, keyed by (SNI, ALPN). The list
+ * quic->p_first_ticket remains the reference, ordered from most to least
+ * recently used, and the index is rebuilt if the list head was changed
+ * without going through the ticket store API.
+ */
+#define PICOQUIC_STORED_INDEX_MIN_BINS 64
+
+typedef struct st_picoquic_stored_ticket_index_t {
+    picoquic_stored_ticket_t** bins;
+    picoquic_stored_ticket_t* indexed_first;
+    picoquic_stored_ticket_t* last_ticket;
+    size_t nb_bins;
+    size_t nb_tickets;
+    size_t max_tickets; /* 0 if not limited */
+} picoquic_stored_ticket_index_t;
+
+void picoquic_free_ticket_index(picoquic_quic_t* quic);
+int picoquic_serialize_ticket(const picoquic_stored_ticket_t* ticket, uint8_t* bytes, size_t bytes_max, size_t* consumed);
+int picoquic_deserialize_ticket(picoquic_stored_ticket_t** ticket, uint8_t* bytes, size_t bytes_max, size_t* consumed);
+
 
 typedef struct st_picoquic_stored_token_t {
     struct st_picoquic_stored_token_t* next_token;
+    struct st_picoquic_stored_token_t* previous_token;
+    struct st_picoquic_stored_token_t* next_in_bin;
+    uint64_t index_hash;
     char const* sni;
     uint8_t const* token;
     uint8_t const* ip_addr;
@@ -532,6 +817,33 @@ int picoquic_save_tokens(picoquic_quic_t* quic,
 int picoquic_load_tokens(picoquic_quic_t* quic, char const* token_file_name);
 void picoquic_free_tokens(picoquic_stored_token_t** pp_first_token);
 
+/* Hash index of the stored tokens, keyed by SNI, managed like the ticket index */
+typedef struct st_picoquic_stored_token_index_t {
+    picoquic_stored_token_t** bins;
+    picoquic_stored_token_t* indexed_first;
+    picoquic_stored_token_t* last_token;
+    size_t nb_bins;
+    size_t nb_tokens;
+    size_t max_tokens; /* 0 if not limited */
+} picoquic_stored_token_index_t;
+
+void picoquic_free_token_index(picoquic_quic_t* quic);
+int picoquic_serialize_token(const picoquic_stored_token_t* token, uint8_t* bytes, size_t bytes_max, size_t* consumed);
+int picoquic_deserialize_token(picoquic_stored_token_t** token, uint8_t* bytes, size_t bytes_max, size_t* consumed);
+
+/* Store of tickets and tokens shared between processes, see shared_store.c */
+typedef struct st_picoquic_shared_store_t picoquic_shared_store_t;
+
+void picoquic_shared_store_publish_ticket(picoquic_quic_t* quic, const picoquic_stored_ticket_t* stored);
+void picoquic_shared_store_forget_ticket(picoquic_quic_t* quic, const picoquic_stored_ticket_t* stored);
+picoquic_stored_ticket_t* picoquic_shared_store_fetch_ticket(picoquic_quic_t* quic,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint32_t version, uint64_t ticket_id);
+void picoquic_shared_store_publish_token(picoquic_quic_t* quic, const picoquic_stored_token_t* stored);
+void picoquic_shared_store_forget_token(picoquic_quic_t* quic, const picoquic_stored_token_t* stored);
+picoquic_stored_token_t* picoquic_shared_store_fetch_token(picoquic_quic_t* quic,
+    char const* sni, uint16_t sni_length, uint8_t const* ip_addr, uint8_t ip_addr_length);
+
 /* Remember the tickets issued by a server, and the last
  * congestion control parameters for the corresponding connection
  */
@@ -558,6 +870,203 @@ int picoquic_remember_issued_ticket(picoquic_quic_t* quic,
 picoquic_issued_ticket_t* picoquic_retrieve_issued_ticket(picoquic_quic_t* quic,
     uint64_t ticket_id);
 
+/* Careful Resume, as in draft-ietf-tsvwg-careful-resume.
+ * The context remembers the RTT and congestion window measured by previous
+ * connections to the same peer address, and uses them to jump start the
+ * congestion window of new connections. See careful_resume.c.
+ */
+typedef struct st_picoquic_resume_record_t {
+    struct st_picoquic_resume_record_t* next_record;
+    struct st_picoquic_resume_record_t* previous_record;
+    picohash_item hash_item;
+    uint64_t saved_time;
+    uint64_t rtt_min;
+    uint64_t cwin;
+    uint8_t ip_addr[PICOQUIC_STORED_IP_MAX];
+    uint8_t ip_addr_length;
+} picoquic_resume_record_t;
+
+typedef struct st_picoquic_careful_resume_t {
+    picohash_table* table;
+    picoquic_resume_record_t* first;
+    picoquic_resume_record_t* last;
+    size_t nb_records;
+    size_t max_records;
+    uint64_t lifetime;
+    uint64_t nb_jumps; /* Connections that jumped to the saved window */
+    uint64_t nb_retreats; /* Jumps abandoned after a loss */
+} picoquic_careful_resume_t;
+
+picoquic_resume_record_t* picoquic_careful_resume_find(picoquic_quic_t* quic,
+    const uint8_t* ip_addr, uint8_t ip_addr_length, uint64_t current_time);
+void picoquic_careful_resume_seed(picoquic_cnx_t* cnx, uint64_t current_time);
+void picoquic_careful_resume_jump(picoquic_cnx_t* cnx, picoquic_path_t* path_x);
+void picoquic_careful_resume_monitor(picoquic_cnx_t* cnx, picoquic_path_t* path_x);
+void picoquic_careful_resume_save(picoquic_cnx_t* cnx, uint64_t current_time);
+void picoquic_careful_resume_free(picoquic_quic_t* quic);
+
+/* Cache of the server transport parameters, see transport.c. The
+ * encoding before and after the connection identifiers is reused by
+ * connections with the same local parameters.
+ */
+#define PICOQUIC_TP_CACHE_MAX 512
+
+typedef struct st_picoquic_tp_cache_t {
+    picoquic_tp_t local_parameters;
+    int version_index;
+    unsigned int do_version_negotiation : 1;
+    unsigned int is_valid : 1;
+    uint64_t nb_hits;
+    size_t prefix_length;
+    size_t suffix_length;
+    uint8_t prefix[PICOQUIC_TP_CACHE_MAX];
+    uint8_t suffix[PICOQUIC_TP_CACHE_MAX];
+} picoquic_tp_cache_t;
+
+void picoquic_tp_cache_free(picoquic_quic_t* quic);
+
+/* Congestion manager. Paths of the connections to the same peer address
+ * or prefix are members of a group, and share the aggregate congestion
+ * window and pacing budget of the group. See cc_manager.c.
+ */
+typedef struct st_picoquic_cc_manager_t {
+    picohash_table* table;
+    uint8_t ipv4_prefix_bits;
+    uint8_t ipv6_prefix_bits;
+    picoquic_congestion_manager_stats_t stats;
+} picoquic_cc_manager_t;
+
+void picoquic_cc_manager_join(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time);
+void picoquic_cc_manager_leave(picoquic_path_t* path_x);
+void picoquic_cc_manager_seed(picoquic_cnx_t* cnx);
+int picoquic_cc_manager_is_blocked(picoquic_path_t* path_x, uint64_t current_time, uint64_t* next_time);
+void picoquic_cc_manager_after_send(picoquic_path_t* path_x, size_t length, uint64_t current_time);
+void picoquic_cc_manager_free(picoquic_quic_t* quic);
+
+/* PMTU cache. The context remembers the path MTU discovered by previous
+ * connections to the same peer address, and probes it first on new paths.
+ * See pmtu_cache.c.
+ */
+typedef struct st_picoquic_pmtu_record_t {
+    struct st_picoquic_pmtu_record_t* next_record;
+    struct st_picoquic_pmtu_record_t* previous_record;
+    picohash_item hash_item;
+    uint64_t saved_time;
+    size_t mtu;
+    uint8_t ip_addr[PICOQUIC_STORED_IP_MAX];
+    uint8_t ip_addr_length;
+} picoquic_pmtu_record_t;
+
+typedef struct st_picoquic_pmtu_cache_t {
+    picohash_table* table;
+    picoquic_pmtu_record_t* first;
+    picoquic_pmtu_record_t* last;
+    size_t nb_records;
+    size_t max_records;
+    uint64_t lifetime;
+    uint64_t nb_hits; /* Paths that started with a cached MTU */
+} picoquic_pmtu_cache_t;
+
+size_t picoquic_pmtu_cache_get(picoquic_quic_t* quic, const struct sockaddr* peer_addr, uint64_t current_time);
+void picoquic_pmtu_cache_save(picoquic_quic_t* quic, const struct sockaddr* peer_addr, size_t mtu, uint64_t current_time);
+void picoquic_pmtu_cache_forget(picoquic_quic_t* quic, const struct sockaddr* peer_addr);
+void picoquic_pmtu_cache_free(picoquic_quic_t* quic);
+
+/* Anti-replay filter for 0-RTT, see anti_replay.c */
+typedef struct st_picoquic_anti_replay_t picoquic_anti_replay_t;
+
+int picoquic_anti_replay_check(picoquic_quic_t* quic, uint64_t ticket_id, uint64_t current_time);
+void picoquic_anti_replay_free(picoquic_quic_t* quic);
+
+/* Session ticket key ring, see ticket_keys.c */
+typedef struct st_picoquic_ticket_key_ring_t picoquic_ticket_key_ring_t;
+
+int picoquic_ticket_key_ring_is_active(picoquic_quic_t* quic);
+void* picoquic_ticket_key_ring_encrypt_ctx(picoquic_quic_t* quic, uint8_t* key_id);
+void* picoquic_ticket_key_ring_decrypt_ctx(picoquic_quic_t* quic, uint8_t key_id);
+void picoquic_ticket_key_ring_free(picoquic_quic_t* quic);
+
+/* Client cache of parsed ECH configurations, see ech.c */
+#define PICOQUIC_ECH_CLIENT_CACHE_MAX 4
+typedef struct st_picoquic_ech_client_cache_t picoquic_ech_client_cache_t;
+
+uint64_t picoquic_ech_get_client_cache_hits(picoquic_quic_t* quic);
+
+/* Client cache of verified certificates, see cert_cache.c */
+typedef struct st_picoquic_cert_cache_t picoquic_cert_cache_t;
+
+void picoquic_cert_cache_wrap(picoquic_quic_t* quic);
+void picoquic_cert_cache_unwrap(picoquic_quic_t* quic);
+void picoquic_cert_cache_flush(picoquic_quic_t* quic);
+void picoquic_cert_cache_free(picoquic_quic_t* quic);
+
+/* Atomic accesses used by the lock free telemetry and metrics readers.
+ * On Windows, the Interlocked functions require "wincompat.h". */
+#ifdef _WINDOWS
+#define PICOQUIC_TELEMETRY_LOAD32(p) ((uint32_t)InterlockedCompareExchange((LONG volatile*)(p), 0, 0))
+#define PICOQUIC_TELEMETRY_STORE32(p, v) (void)InterlockedExchange((LONG volatile*)(p), (LONG)(v))
+#define PICOQUIC_TELEMETRY_INCREF(p) (uint32_t)InterlockedIncrement((LONG volatile*)(p))
+#define PICOQUIC_TELEMETRY_DECREF(p) (uint32_t)InterlockedDecrement((LONG volatile*)(p))
+#define PICOQUIC_TELEMETRY_LOAD64(p) ((uint64_t)InterlockedCompareExchange64((LONG64 volatile*)(p), 0, 0))
+#define PICOQUIC_TELEMETRY_STORE64(p, v) (void)InterlockedExchange64((LONG64 volatile*)(p), (LONG64)(v))
+#define PICOQUIC_TELEMETRY_WRITE_FENCE() MemoryBarrier()
+#define PICOQUIC_TELEMETRY_READ_FENCE() MemoryBarrier()
+#else
+#define PICOQUIC_TELEMETRY_LOAD32(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PICOQUIC_TELEMETRY_STORE32(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define PICOQUIC_TELEMETRY_INCREF(p) __atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define PICOQUIC_TELEMETRY_DECREF(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define PICOQUIC_TELEMETRY_LOAD64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PICOQUIC_TELEMETRY_STORE64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define PICOQUIC_TELEMETRY_WRITE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define PICOQUIC_TELEMETRY_READ_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+/* Congestion control telemetry rings, see cc_telemetry.c */
+void picoquic_cc_telemetry_attach(picoquic_cnx_t* cnx, picoquic_path_t* path_x);
+void picoquic_cc_telemetry_detach(picoquic_path_t* path_x);
+void picoquic_cc_telemetry_record(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time);
+
+/* Connection statistics snapshots, see cnx_stats.c */
+void picoquic_cnx_stats_attach(picoquic_cnx_t* cnx);
+void picoquic_cnx_stats_detach(picoquic_cnx_t* cnx);
+void picoquic_cnx_stats_record(picoquic_cnx_t* cnx, uint64_t current_time);
+void picoquic_copy_path_quality(picoquic_path_t* path_x, picoquic_path_quality_t* quality);
+
+/* Context metrics, see quic_metrics.c. The counters in "live" are
+ * only accessed by the network thread. Publication n is copied to
+ * slot n % 2, protected by a sequence number as in cc_telemetry.c */
+typedef struct st_picoquic_quic_metrics_slot_t {
+    volatile uint64_t seq;
+    picoquic_quic_metrics_t metrics;
+} picoquic_quic_metrics_slot_t;
+
+typedef struct st_picoquic_quic_metrics_ctx_t {
+    picoquic_quic_metrics_t live;
+    uint64_t publish_interval;
+    uint64_t next_publish_time;
+    uint64_t last_publish_time;
+    uint64_t last_nb_handshakes;
+    volatile uint64_t nb_published;
+    picoquic_quic_metrics_slot_t slot[2];
+} picoquic_quic_metrics_ctx_t;
+
+void picoquic_metrics_histogram_add(picoquic_metrics_histogram_t* histogram, uint64_t value);
+void picoquic_metrics_handshake_done(picoquic_cnx_t* cnx, uint64_t current_time);
+void picoquic_metrics_datagrams_sent(picoquic_quic_t* quic, size_t send_length, size_t segment_size);
+
+/* CPU cost accounting. A mark is taken before receiving a packet, preparing
+ * a packet or calling the application. The ticks elapsed since the mark
+ * exclude the application callbacks made in between. */
+typedef struct st_picoquic_cpu_mark_t {
+    uint64_t ticks;
+    uint64_t app_ticks;
+} picoquic_cpu_mark_t;
+
+void picoquic_cpu_mark(picoquic_quic_t* quic, picoquic_cpu_mark_t* mark);
+uint64_t picoquic_cpu_elapsed(picoquic_quic_t* quic, const picoquic_cpu_mark_t* mark);
+void picoquic_cpu_account_app(picoquic_cnx_t* cnx, const picoquic_cpu_mark_t* mark);
+
 /*
  * Transport parameters, as defined by the QUIC transport specification.
  * The initial code defined the type as an enum, but the binary representation
@@ -594,6 +1103,7 @@ typedef uint64_t picoquic_tp_enum;
 #define picoquic_tp_enable_bdp_frame 0xebd9 /* per draft-kuhn-quic-0rtt-bdp-09 */
 #define picoquic_tp_initial_max_path_id 0x0f739bbc1b666d0dull /* per draft quic multipath 13 */ 
 #define picoquic_tp_address_discovery 0x9f81a176 /* per draft-seemann-quic-address-discovery */
+#define picoquic_tp_enable_fec 0xfec1 /* experimental, see fec.c */
 
 /* Callback for converting binary log to quic log at the end of a connection. 
  * This is kept private for now; and will only be set through the "set quic log"
@@ -601,13 +1111,49 @@ typedef uint64_t picoquic_tp_enum;
  */
 typedef int (*picoquic_autoqlog_fn)(picoquic_cnx_t * cnx);
 
+/* Streaming qlog, also set through the "set quic log" API. The binary log
+ * records of the connection are passed to the stream as they are produced,
+ * without the length prefix, and the stream is closed after the last record.
+ * With the asynchronous binlog writer, both calls happen in the writer thread.
+ */
+typedef struct st_picoquic_qlog_stream_t {
+    void (*record_fn)(struct st_picoquic_qlog_stream_t* stream, const uint8_t* bytes, size_t length);
+    void (*close_fn)(struct st_picoquic_qlog_stream_t* stream);
+} picoquic_qlog_stream_t;
+
+typedef picoquic_qlog_stream_t* (*picoquic_qlog_stream_open_fn)(picoquic_cnx_t* cnx);
+
 /* Callback used for the performance log
  */
 typedef int (*picoquic_performance_log_fn)(picoquic_quic_t* quic, picoquic_cnx_t* cnx, int should_delete);
 
+/* Pool of fixed size objects, see picoquic_set_object_allocator.
+ * Free objects are chained through their first bytes.
+ */
+typedef struct st_picoquic_object_pool_t {
+    void* first_free;
+    picoquic_object_pool_stats_t stats;
+} picoquic_object_pool_t;
+
 /* QUIC context, defining the tables of connections,
  * open sockets, etc.
  */
+/* Buffered random generator, used for connection IDs, path challenges and
+ * other values that must be unpredictable but are not keys. The buffer is
+ * filled by a ChaCha20 generator keyed from the crypto provider, see
+ * picoquic_buffered_random in tls_api.c.
+ */
+#define PICOQUIC_RANDOM_POOL_SIZE 512
+#define PICOQUIC_RANDOM_RESEED_BYTES (1ull << 20)
+
+typedef struct st_picoquic_random_pool_t {
+    uint32_t key[8];
+    size_t available;
+    uint64_t bytes_since_reseed;
+    uint64_t nb_reseeds;
+    uint8_t buffer[PICOQUIC_RANDOM_POOL_SIZE];
+} picoquic_random_pool_t;
+
 typedef struct st_picoquic_quic_t {
     void* tls_master_ctx;
     picoquic_stream_data_cb_fn default_callback_fn;
@@ -622,10 +1168,18 @@ typedef struct st_picoquic_quic_t {
     char const* token_file_name;
     picoquic_stored_ticket_t * p_first_ticket;
     picoquic_stored_token_t * p_first_token;
-    picosplay_tree_t token_reuse_tree; /* detection of token reuse */
+    picoquic_stored_ticket_index_t ticket_index;
+    picoquic_stored_token_index_t token_index;
+    picoquic_shared_store_t* shared_store; /* NULL unless attached */
+    picoquic_token_registry_t token_registry; /* detection of token reuse */
+    picoquic_initial_rate_limiter_t* initial_rate_limiter; /* NULL unless enabled */
+    picoquic_admission_ctx_t* admission; /* NULL unless enabled */
+    picoquic_tombstone_ctx_t* tombstones; /* NULL unless compact closing is enabled */
+    picoquic_egress_ctx_t* egress; /* NULL unless the egress scheduler is enabled */
     uint8_t local_cnxid_length;
     uint8_t default_stream_priority;
     uint8_t default_datagram_priority;
+    uint8_t default_fec_block_size;
     uint64_t local_cnxid_ttl; /* Max time to live of Connection ID in microsec, init to "forever" */
     uint32_t mtu_max;
     uint32_t padding_multiple_default;
@@ -672,36 +1226,100 @@ typedef struct st_picoquic_quic_t {
     unsigned int is_port_blocking_disabled : 1; /* Do not check client port on incoming connections */
     unsigned int are_path_callbacks_enabled : 1; /* Enable path specific callbacks by default */
     unsigned int use_predictable_random : 1; /* For logging tests */
-    picoquic_stateless_packet_t* pending_stateless_packet;
+    unsigned int is_receive_batch_open : 1; /* ACK processing is deferred to the end of the receive batch */
+    unsigned int is_in_place_decryption_enabled : 1; /* Short header packets are decrypted in the receive buffer */
+    unsigned int is_cpu_accounting_enabled : 1; /* Count CPU ticks per connection, see picoquic_set_cpu_accounting */
+    unsigned int is_adaptive_ack_frequency_enabled : 1; /* see picoquic_set_adaptive_ack_frequency */
+    unsigned int is_qlog_json_seq : 1; /* Streaming qlog in JSON-SEQ format, see picoquic_set_qlog_json_seq */
+    unsigned int is_hystart_pp_enabled : 1; /* see picoquic_set_hystart_pp */
+    unsigned int is_stream_repeat_from_queue : 1; /* see picoquic_set_stream_repeat_from_queue_policy */
+    unsigned int is_clock_cache_enabled : 1; /* picoquic_get_quic_time returns cached_time, see picoquic_set_clock_cache */
+    unsigned int is_fast_port_rebinding : 1; /* see picoquic_set_fast_port_rebinding_policy */
+    uint64_t cached_time;
+    picoquic_stateless_packet_t* pending_stateless_packet; /* Packets allocated outside the ring */
+    picoquic_stateless_packet_t* stateless_ring; /* Allocated on first use */
+    size_t stateless_ring_size;
+    size_t stateless_ring_head;
+    size_t stateless_ring_count;
+    uint8_t vn_version_list[4 * PICOQUIC_NB_SUPPORTED_VERSIONS_MAX]; /* Encoded list of supported versions, filled at creation */
+    size_t vn_version_list_length;
+    picoquic_stateless_full_policy_enum stateless_full_policy;
+    uint64_t nb_stateless_packets_dropped;
 
     picoquic_congestion_algorithm_t const* default_congestion_alg;
     char const* default_congestion_alg_option_string;
+    picoquic_path_scheduler_t const* default_path_scheduler;
 
     struct st_picoquic_cnx_t* cnx_list;
     struct st_picoquic_cnx_t* cnx_last;
     picosplay_tree_t cnx_wake_tree;
+    picowheel_t* cnx_wake_wheel; /* If not NULL, used instead of cnx_wake_tree */
+    /* Timer coalescing, see picoquic_set_timer_slack */
+    uint64_t timer_slack;
+    uint64_t nb_wakeups;
+    uint64_t wakeup_window_start;
+    uint64_t wakeup_window_count;
+    uint64_t wakeups_per_second;
 
     struct st_picoquic_cnx_t* cnx_in_progress;
+    struct st_picoquic_cnx_t* ack_batch_first; /* Connections with pending ACK batches */
+    struct st_picoquic_cnx_t* wake_batch_first; /* Connections to reinsert in the wake list at the end of the receive batch */
+    struct st_picoquic_cnx_t* delivery_batch_first; /* Connections with data to deliver at the end of the receive batch */
+    struct st_picoquic_hp_mask_batch_t* hp_mask_batch; /* Allocated on first use */
+    struct st_picoquic_local_cnxid_t* last_incoming_l_cid; /* Local CID of the last short header packet */
+    uint64_t nb_in_place_decryptions;
+    picoquic_async_wake_fn async_wake_fn; /* Called from worker threads when an async operation completes */
+    void* async_wake_ctx;
+    size_t nb_parked_handshakes;
+    void* cert_compress_ctx; /* Cache of compressed certificate messages, see cert_compress.c */
+    struct st_picoquic_key_share_pool_t* key_share_pool; /* NULL unless enabled, see tls_keyshare.c */
 
     picohash_table* table_cnx_by_id;
     picohash_table* table_cnx_by_net;
     picohash_table* table_cnx_by_icid;
     picohash_table* table_cnx_by_secret;
+    picoquic_reset_filter_t reset_filter;
 
     picohash_table* table_issued_tickets;
     picoquic_issued_ticket_t* table_issued_tickets_first;
     picoquic_issued_ticket_t* table_issued_tickets_last;
     size_t table_issued_tickets_nb;
+    picoquic_careful_resume_t* careful_resume; /* NULL unless enabled */
+    picoquic_tp_cache_t* tp_cache; /* NULL until the first server handshake */
+    struct st_picoquic_initial_key_cache_t* initial_key_cache; /* NULL until the first Initial is screened */
+    picoquic_cc_manager_t* cc_manager; /* NULL unless the congestion manager is enabled */
+    picoquic_pmtu_cache_t* pmtu_cache; /* NULL unless enabled */
+    picoquic_anti_replay_t* anti_replay; /* NULL unless enabled */
+    picoquic_ticket_key_ring_t* ticket_keys; /* NULL unless enabled */
+    picoquic_cert_cache_t* cert_cache; /* NULL unless enabled */
+    picoquic_ech_client_cache_t* ech_client_cache; /* NULL until an ECH client connection is configured */
+    picoquic_random_pool_t random_pool; /* buffered random, for CIDs and challenges */
+    picoquic_quic_metrics_ctx_t* metrics; /* NULL unless enabled */
 
     picoquic_packet_t * p_first_packet;
-    int nb_packets_in_pool;
+    picoquic_packet_t* p_first_small_packet;
+    picoquic_packet_t* p_first_jumbo_packet;
+    int nb_packets_in_pool; /* All size classes */
     int nb_packets_allocated;
     int nb_packets_allocated_max;
 
     picoquic_stream_data_node_t* p_first_data_node;
-    int nb_data_nodes_in_pool;
+    picoquic_stream_data_node_t* p_first_small_data_node;
+    picoquic_stream_data_node_t* p_first_jumbo_data_node;
+    int nb_data_nodes_in_pool; /* All size classes */
     int nb_data_nodes_allocated;
     int nb_data_nodes_allocated_max;
+    picoquic_tuning_t tuning; /* pool sizes and batch limits, see picoquic_set_tuning */
+    picoquic_prewarm_slab_t* prewarm_slabs;
+
+    picoquic_object_pool_t object_pool[picoquic_object_type_max];
+    picoquic_object_alloc_fn object_alloc_fn;
+    picoquic_object_free_fn object_free_fn;
+    void* object_allocator_ctx;
+
+    size_t memory_used_total; /* Sum of the memory accounted in all connections */
+    size_t default_cnx_memory_budget;
+    uint64_t default_hibernation_delay;
 
     picoquic_connection_id_cb_fn cnx_id_callback_fn;
     void* cnx_id_callback_ctx;
@@ -723,6 +1341,8 @@ typedef struct st_picoquic_quic_t {
 
     /* Global flow control enforcement */
     uint64_t max_data_limit;
+    uint64_t rcv_window_max; /* zero if receive window autotuning is disabled */
+    uint64_t max_streams_increment_max; /* zero if MAX_STREAMS autotuning is disabled */
 
     /* Path quality callback. These variables store the default values
     * of the min deltas required to perform path quality signaling.
@@ -730,16 +1350,36 @@ typedef struct st_picoquic_quic_t {
     uint64_t rtt_update_delta;
     uint64_t pacing_rate_update_delta;
 
+    /* Congestion control telemetry, disabled if nb_samples is 0 */
+    size_t cc_telemetry_nb_samples;
+    uint64_t cc_telemetry_interval;
+    /* Connection statistics snapshots, disabled if the interval is 0 */
+    uint64_t cnx_stats_interval;
+    /* Pacing horizon, when packets are released with a departure time */
+    uint64_t pacing_horizon_microsec;
+
     /* Logging APIS */
     void* F_log;
+    void* F_textlog_file; /* File behind F_log if the text log goes through the async writer */
+    char* textlog_buffer; /* Memory buffer behind F_log, in that case */
+    uint64_t textlog_max_lines_per_second; /* Per connection rate limit of the text log, 0 if none */
     char* binlog_dir;
     char* qlog_dir;
     picoquic_autoqlog_fn autoqlog_fn;
+    picoquic_qlog_stream_open_fn qlog_stream_open_fn;
     struct st_picoquic_unified_logging_t* text_log_fns;
     struct st_picoquic_unified_logging_t* bin_log_fns;
+    struct st_picoquic_binlog_async_t* binlog_async; /* Asynchronous binlog writer, if enabled */
+    struct st_picoquic_log_policy_ctx_t* log_policy; /* Sampling, filters and flight recorder, if set */
+    size_t binlog_block_size; /* Compressed binlog blocks if not zero, see picoquic_set_binlog_compression */
     struct st_picoquic_unified_logging_t* qlog_fns;
     picoquic_performance_log_fn perflog_fn;
     void* v_perflog_ctx;
+    /* Memory log shared by all connections, see memlog_ring_init. Called with
+     * a NULL connection and op_code 1 when the context is freed. */
+    void (*memlog_call_back)(picoquic_cnx_t* cnx, picoquic_path_t* path, void* v_memlog, int op_code, uint64_t current_time);
+    void* memlog_ctx;
+    uint64_t cpu_ticks_app; /* Total of the application callback ticks, see picoquic_cpu_mark */
 
 #ifdef BBRExperiment
     bbr_exp bbr_exp_flags;
@@ -747,6 +1387,14 @@ typedef struct st_picoquic_quic_t {
 
 } picoquic_quic_t;
 
+/* QUIC group, see picoquic_create_quic_group */
+#define PICOQUIC_GROUP_TICKET_KEY_SIZE 32
+
+typedef struct st_picoquic_quic_group_t {
+    int nb_shards;
+    picoquic_quic_t** shard;
+} picoquic_quic_group_t;
+
 picoquic_packet_context_enum picoquic_context_from_epoch(int epoch);
 
 int picoquic_registered_token_check_reuse(picoquic_quic_t* quic, const uint8_t* token, size_t token_length, uint64_t expiry_time);
@@ -761,7 +1409,6 @@ void picoquic_registered_token_clear(picoquic_quic_t* quic, uint64_t expiry_time
  */
 
 typedef struct st_picoquic_sack_item_t {
-    picosplay_node_t node;
     uint64_t start_of_sack_range;
     uint64_t end_of_sack_range;
     uint64_t time_created;
@@ -772,11 +1419,23 @@ typedef struct st_picoquic_sack_range_count_t {
     int range_counts[PICOQUIC_MAX_ACK_RANGE_REPEAT];
 } picoquic_sack_range_count_t;
 
+#define PICOQUIC_SACK_INLINE_ITEMS 4
+
+/* The ranges are kept in increasing order in an array. Up to
+ * PICOQUIC_SACK_INLINE_ITEMS ranges are stored in the list itself;
+ * larger lists are allocated, and "items" is then not NULL. */
 typedef struct st_picoquic_sack_list_t {
-    picosplay_tree_t ack_tree;
+    picoquic_sack_item_t* items;
+    size_t nb_items;
+    size_t nb_items_max;
+    picoquic_sack_item_t items_inline[PICOQUIC_SACK_INLINE_ITEMS];
     uint64_t ack_horizon;
     int64_t horizon_delay;
     picoquic_sack_range_count_t rc[2];
+    /* All ranges ending below the scan floor have been sent more than
+     * PICOQUIC_MAX_ACK_RANGE_REPEAT times, and will not be selected again
+     * unless they are modified. The ACK encoder stops scanning there. */
+    uint64_t ack_scan_floor[2];
 } picoquic_sack_list_t;
 
 /*
@@ -802,6 +1461,38 @@ typedef struct st_picoquic_sack_list_t {
  * The stream structure holds a variety of parameters about the state of the stream.
  */
 
+/* Receive window autotuning state, see picoquic_set_receive_window_autotuning.
+ * The data received during each RTT epoch sets the window target. */
+typedef struct st_picoquic_rcv_autotune_t {
+    uint64_t epoch_time; /* Start of the current measurement epoch, 0 if not started */
+    uint64_t epoch_offset; /* Data received or consumed at the start of the epoch */
+    uint64_t window; /* Current receive window */
+} picoquic_rcv_autotune_t;
+
+/* MAX_STREAMS autotuning state, see picoquic_set_max_streams_autotuning.
+ * The remote streams released during each RTT epoch set the credit increment. */
+typedef struct st_picoquic_streams_autotune_t {
+    uint64_t epoch_time; /* Start of the current measurement epoch, 0 if not started */
+    uint64_t epoch_computed; /* Value of max_stream_id_*_local_computed at the start of the epoch */
+    uint64_t increment; /* Number of streams added to the limit in each MAX_STREAMS frame */
+} picoquic_streams_autotune_t;
+
+/* Deadline of a range of stream data, see picoquic_add_to_stream_with_deadline */
+typedef struct st_picoquic_stream_deadline_t {
+    struct st_picoquic_stream_deadline_t* next_deadline;
+    uint64_t start_offset;
+    uint64_t end_offset;
+    uint64_t deadline;
+} picoquic_stream_deadline_t;
+
+/* Range of lost stream data waiting to be resent from the retained send queue */
+typedef struct st_picoquic_stream_repeat_t {
+    struct st_picoquic_stream_repeat_t* next_repeat;
+    uint64_t offset;
+    uint64_t length;
+    int is_fin;
+} picoquic_stream_repeat_t;
+
 typedef struct st_picoquic_stream_head_t {
     picosplay_node_t stream_node; /* splay of streams in connection context */
     struct st_picoquic_stream_head_t * next_output_stream; /* link in the list of output streams */
@@ -810,10 +1501,12 @@ typedef struct st_picoquic_stream_head_t {
     uint64_t stream_id;
     struct st_picoquic_path_t * affinity_path; /* Path for which affinity is set, or NULL if none */
     uint64_t consumed_offset; /* amount of data consumed by the application */
+    uint64_t app_consumed_offset; /* amount of data released by the application, if is_app_flow_controlled */
     uint64_t fin_offset; /* If the fin mark is received, index of the byte after last */
     uint64_t maxdata_local; /* flow control limit of how much the peer is authorized to send */
     uint64_t maxdata_local_acked; /* highest value in max stream data frame acked by the peer */
     uint64_t maxdata_remote; /* flow control limit of how much we authorize the peer to send */
+    picoquic_rcv_autotune_t rcv_autotune;
     uint64_t local_error;
     uint64_t remote_error;
     uint64_t local_stop_error;
@@ -822,12 +1515,30 @@ typedef struct st_picoquic_stream_head_t {
     picosplay_tree_t stream_data_tree; /* splay of received stream segments */
     uint64_t sent_offset; /* Amount of data sent in the stream */
     picoquic_stream_queue_node_t* send_queue; /* if the stream is not "active", list of data segments ready to send */
+    picoquic_stream_queue_node_t* cork_node; /* Data coalesced while the stream or connection is corked, not yet queued */
+    size_t cork_capacity; /* Number of bytes allocated in the cork node */
+    uint64_t send_backlog; /* Bytes queued by the application and not yet sent */
+    uint64_t backlog_high; /* Send backlog watermarks, none if high is 0 */
+    uint64_t backlog_low;
     void * app_stream_ctx;
+    uint64_t deadline; /* Deadline for all the stream data, 0 if none */
+    uint64_t deadline_error; /* Reset error code when data expires */
+    picoquic_stream_deadline_t* first_deadline; /* Deadlines of ranges of data, by increasing offset */
+    picoquic_stream_deadline_t* last_deadline;
+    picoquic_stream_queue_node_t* first_retained; /* Sent data kept until acked, if is_stream_repeat_from_queue */
+    picoquic_stream_queue_node_t* last_retained;
+    picoquic_stream_repeat_t* first_repeat; /* Lost ranges to resend from the retained data, by increasing offset */
+    struct st_picoquic_stream_head_t* next_repeat_stream; /* link in the connection list of streams with repeats */
+    struct st_picoquic_packet_t* data_repeat_hint; /* last packet queued for data repeat with this stream, if any */
+    struct st_picoquic_stream_head_t* previous_repeat_stream;
+    struct st_picoquic_stream_head_t* next_delivery_stream; /* link in the connection list of batched deliveries */
     picoquic_stream_direct_receive_fn direct_receive_fn; /* direct receive function, if not NULL */
     void* direct_receive_ctx; /* direct receive context */
+    struct st_picoquic_reassembly_ring_t* reassembly_ring; /* If not NULL, received data is reassembled in that ring */
     picoquic_sack_list_t sack_list; /* Track which parts of the stream were acknowledged by the peer */
     /* Stream priority -- lowest is most urgent */
     uint8_t stream_priority;
+    uint8_t output_priority; /* Priority of the output bucket in which the stream is listed */
     /* Flags describing the state of the stream */
     unsigned int is_active : 1; /* The application is actively managing data sending through callbacks */
     unsigned int fin_requested : 1; /* Application has requested Fin of sending stream */
@@ -848,8 +1559,52 @@ typedef struct st_picoquic_stream_head_t {
     unsigned int is_output_stream : 1; /* If stream is listed in the output list */
     unsigned int is_closed : 1; /* Stream is closed, closure is accouted for */
     unsigned int is_discarded : 1; /* There should be no more callback for that stream, the application has discarded it */
+    unsigned int is_corked : 1; /* Small writes are coalesced until uncork, see picoquic_cork_stream */
+    unsigned int is_repeat_stream : 1; /* If stream is listed in the connection list of streams with repeats */
+    unsigned int is_delivery_queued : 1; /* If stream has data waiting for the end of the receive batch */
+    unsigned int is_backlog_high : 1; /* Send backlog reached the high watermark, and not yet drained to the low */
+    unsigned int is_app_flow_controlled : 1; /* Flow control credit follows app_consumed_offset, see picoquic_set_app_flow_control */
 } picoquic_stream_head_t;
 
+/* Reassembly ring, see picoquic_set_stream_reassembly_ring.
+ * The ring holds the stream data in the window [consumed_offset, consumed_offset + size).
+ * The octet at offset "o" is stored at position "o % size" of the buffer, and the bit
+ * at the same position in the "received" bitmap is set once that octet is received.
+ * Bits for the octets below "base_offset" have already been cleared.
+ */
+typedef struct st_picoquic_reassembly_ring_t {
+    uint8_t* buffer;
+    uint64_t* received;
+    size_t size; /* multiple of 64 */
+    uint64_t base_offset;
+} picoquic_reassembly_ring_t;
+
+size_t picoquic_reassembly_ring_input(picoquic_stream_head_t* stream, uint64_t offset, const uint8_t* bytes, size_t length);
+void picoquic_reassembly_ring_free(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+
+/* Scratch space for the coalesced delivery of stream data and datagrams.
+ * Datagrams are copied in "datagram_bytes", since the packets that carry
+ * them do not survive the end of their processing.
+ */
+typedef struct st_picoquic_delivery_batch_t {
+    picoquic_iovec_t* iov;
+    size_t iov_allocated;
+    uint8_t* datagram_bytes;
+    size_t datagram_bytes_allocated;
+    size_t datagram_bytes_used;
+    size_t* datagram_lengths;
+    size_t datagram_lengths_allocated;
+    size_t nb_datagrams;
+} picoquic_delivery_batch_t;
+
+/* Streams of the same priority level in the output list, see picoquic_insert_output_stream */
+typedef struct st_picoquic_output_bucket_t {
+    picoquic_stream_head_t* first;
+    picoquic_stream_head_t* last;
+    picoquic_stream_head_t* last_unserved; /* Round robin levels: last of the streams never served */
+    uint8_t priority;
+} picoquic_output_bucket_t;
+
 #define IS_CLIENT_STREAM_ID(id) (unsigned int)(((id) & 1) == 0)
 #define IS_BIDIR_STREAM_ID(id)  (unsigned int)(((id) & 2) == 0)
 #define IS_LOCAL_STREAM_ID(id, client_mode)  (unsigned int)(((id)^(client_mode)) & 1)
@@ -870,14 +1625,87 @@ typedef struct st_picoquic_stream_head_t {
  * misc_frame_header, followed by the misc frame content.
  */
 
+#define PICOQUIC_MISC_FRAME_SMALL_SIZE 64
+#define PICOQUIC_MISC_FRAME_MEDIUM_SIZE 256
+#define PICOQUIC_MISC_FRAME_LARGE_SIZE PICOQUIC_MAX_PACKET_SIZE
+
 typedef struct st_picoquic_misc_frame_header_t {
     struct st_picoquic_misc_frame_header_t* next_misc_frame;
     struct st_picoquic_misc_frame_header_t* previous_misc_frame;
     size_t length;
     picoquic_packet_context_enum pc;
     int is_pure_ack;
+    picoquic_object_type_enum object_type; /* Size class, picoquic_object_type_max if not pooled */
 } picoquic_misc_frame_header_t;
 
+/* Datagram send ring, see picoquic_set_datagram_send_ring.
+ * The slots between first_slot and first_slot + nb_queued (modulo nb_slots)
+ * are in use, in queuing order. Each slot points to its own preallocated
+ * buffer. Removing a slot in the middle of the ring shifts the slots that
+ * precede it, which only swaps buffer pointers. */
+typedef struct st_picoquic_datagram_slot_t {
+    uint8_t* bytes;
+    size_t length;
+    uint64_t expiry_time;
+    uint8_t priority;
+} picoquic_datagram_slot_t;
+
+typedef struct st_picoquic_datagram_ring_t {
+    picoquic_datagram_slot_t* slots;
+    size_t nb_slots;
+    size_t slot_size;
+    size_t first_slot;
+    size_t nb_queued;
+    uint64_t nb_expired;
+    uint64_t nb_dropped;
+} picoquic_datagram_ring_t;
+
+/* Forward error correction, see fec.c.
+ * The sender computes the XOR of the payloads of up to PICOQUIC_FEC_WINDOW_MAX
+ * protected packets. The receiver keeps the payloads of the last
+ * PICOQUIC_FEC_CACHE_SIZE packets, and the last PICOQUIC_FEC_REPAIRS_MAX
+ * repair symbols that could not be used yet.
+ */
+#define PICOQUIC_FEC_WINDOW_MAX 16
+#define PICOQUIC_FEC_CACHE_SIZE 32
+#define PICOQUIC_FEC_REPAIRS_MAX 4
+#define PICOQUIC_FEC_REPAIR_OVERHEAD 64
+
+typedef struct st_picoquic_fec_sender_t {
+    uint64_t first_pn;
+    uint64_t first_time;
+    uint64_t pn_mask;
+    uint64_t length_xor;
+    size_t nb_symbols;
+    size_t symbol_length;
+    uint8_t symbol[PICOQUIC_MAX_PACKET_SIZE];
+    size_t repair_length;
+    uint8_t repair_frame[PICOQUIC_MAX_PACKET_SIZE];
+} picoquic_fec_sender_t;
+
+typedef struct st_picoquic_fec_symbol_t {
+    uint64_t pn;
+    size_t length;
+    int is_valid;
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+} picoquic_fec_symbol_t;
+
+typedef struct st_picoquic_fec_repair_t {
+    uint64_t first_pn;
+    uint64_t pn_mask;
+    uint64_t length_xor;
+    size_t symbol_length;
+    int is_valid;
+    uint8_t symbol[PICOQUIC_MAX_PACKET_SIZE];
+} picoquic_fec_repair_t;
+
+typedef struct st_picoquic_fec_receiver_t {
+    uint64_t highest_pn;
+    size_t next_repair;
+    picoquic_fec_symbol_t cache[PICOQUIC_FEC_CACHE_SIZE];
+    picoquic_fec_repair_t repairs[PICOQUIC_FEC_REPAIRS_MAX];
+} picoquic_fec_receiver_t;
+
 /* Per epoch sequence/packet context.
 * There are three such contexts:
 * 0: Application (0-RTT and 1-RTT)
@@ -887,6 +1715,19 @@ typedef struct st_picoquic_misc_frame_header_t {
 * resending of packets.
 */
 
+/*
+* Ring index of queued packets, keyed by sequence number. The packet
+* number N is found in slot N & (nb_slots - 1). The ring doubles when two
+* queued packets map to the same slot. If the queue spans more than
+* PICOQUIC_PACKET_INDEX_MAX_SLOTS numbers, the index is disabled and the
+* queue is searched linearly.
+*/
+typedef struct st_picoquic_packet_index_t {
+    picoquic_packet_t** slots;
+    size_t nb_slots; /* power of 2 */
+    unsigned int is_disabled : 1; /* too wide, use the list instead */
+} picoquic_packet_index_t;
+
 typedef struct st_picoquic_packet_context_t {
     uint64_t send_sequence; /* picoquic_decode_ack_frame */
     uint64_t next_sequence_hole;
@@ -899,6 +1740,12 @@ typedef struct st_picoquic_packet_context_t {
     picoquic_packet_t* retransmitted_newest;
     picoquic_packet_t* retransmitted_oldest;
     picoquic_packet_t* preemptive_repeat_ptr;
+    picoquic_packet_index_t pending_index;
+    picoquic_packet_index_t retransmitted_index;
+    /* Loss detection deadline: until that time, the oldest pending packet,
+     * loss_check_sequence, cannot be declared lost unless an ACK arrives. */
+    uint64_t loss_check_time;
+    uint64_t loss_check_sequence;
     /* monitor size of queues */
     uint64_t retransmitted_queue_size;
     /* ECN Counters */
@@ -987,14 +1834,26 @@ typedef struct st_picoquic_remote_cnxid_t {
     unsigned int needs_removal : 1;
     unsigned int retire_sent : 1;
     unsigned int retire_acked : 1;
+    unsigned int is_indexed : 1; /* Present in the sequence ring of the stash */
     picoquic_packet_context_t pkt_ctx;
+    struct st_picoquic_remote_cnxid_t* previous;
 } picoquic_remote_cnxid_t;
 
+/* The remote CIDs are kept in arrival order in a doubly linked list. They are
+ * also indexed by sequence number in a ring sized from the local value of
+ * active_connection_id_limit, so that retiring or finding a CID does not
+ * require scanning the list. Since the peer picks the sequence numbers, two
+ * CIDs may collide on a ring slot; the second one is then not indexed, and
+ * lookups fall back to scanning the list while there are such CIDs. */
 typedef struct st_picoquic_remote_cnxid_stash_t {
     struct st_picoquic_remote_cnxid_stash_t* next_stash;
     uint64_t unique_path_id;
     uint64_t retire_cnxid_before;
     picoquic_remote_cnxid_t* cnxid_stash_first;
+    picoquic_remote_cnxid_t* cnxid_stash_last;
+    picoquic_remote_cnxid_t** cnxid_ring;
+    size_t cnxid_ring_size; /* Power of 2 */
+    size_t nb_cnxid_not_indexed;
     unsigned int is_in_use : 1;
 } picoquic_remote_cnxid_stash_t;
 
@@ -1019,8 +1878,23 @@ typedef struct st_picoquic_pacing_t {
     /* High precision variables should only be used inside pacing.c */
     int64_t bucket_nanosec;
     int64_t packet_time_nanosec;
+    uint64_t packet_time_picosec; /* Sub nanosecond precision, avoids rounding drift at high rates */
+    uint64_t credit_remainder_picosec;
+    int64_t horizon_nanosec; /* Packets may be sent that far ahead of their departure time */
+    uint64_t last_departure_nanosec; /* Departure time of the last packet sent */
 } picoquic_pacing_t;
 
+/* Group of paths sharing a congestion window, see cc_manager.c */
+typedef struct st_picoquic_cc_group_t {
+    picohash_item hash_item;
+    uint8_t prefix[PICOQUIC_STORED_IP_MAX];
+    uint8_t prefix_length;
+    struct st_picoquic_path_t* first_member;
+    int nb_members;
+    uint64_t cwin; /* Aggregate window when the pacing was last updated */
+    picoquic_pacing_t pacing;
+} picoquic_cc_group_t;
+
 /* Tuple context.
 * Tuple context are created to hold address and port pairs used to contact peers.
 * Address pairs are "verified" by successful path challenge/response exchanges.
@@ -1057,6 +1931,10 @@ typedef struct st_picoquic_tuple_t {
     uint64_t challenge_time_first;
     uint64_t is_nat_rebinding;
     uint8_t challenge_repeat_count;
+    /* Fast port rebinding, see picoquic_set_fast_port_rebinding_policy */
+    struct sockaddr_storage rebinding_previous_addr;
+    uint64_t rebinding_sent_base;
+    uint64_t rebinding_received_base;
     /* Flags */
     unsigned int is_backup;
     unsigned int challenge_required : 1;
@@ -1064,6 +1942,7 @@ typedef struct st_picoquic_tuple_t {
     unsigned int challenge_failed : 1;
     unsigned int response_required : 1;
     unsigned int to_preferred_address : 1;
+    unsigned int is_rebinding_pending : 1; /* The peer port changed, the new port is being validated */
 } picoquic_tuple_t;
 
 /*
@@ -1087,29 +1966,13 @@ typedef struct st_picoquic_tuple_t {
 * Packet numbering is global, see packet context.
 */
 typedef struct st_picoquic_path_t {
-    struct sockaddr_storage registered_peer_addr;
-    picohash_item net_id_hash_item;
+    /* Hot section: fields used for each packet sent or received on the path.
+     * See picoquic_cnx_t, and path_layout_test. */
     struct st_picoquic_cnx_t* cnx;
-    uint64_t unique_path_id;
-    void* app_path_ctx;
-    /* If using unique path id multipath */
-    picoquic_ack_context_t ack_ctx;
-    picoquic_packet_context_t pkt_ctx;
     /* First tuple is the one used by default for the path */
     picoquic_tuple_t* first_tuple;
-    /* Manage the transmission of observed addresses */
-    /* TODO: tie management to path/tuple creation. */
-    uint64_t observed_address_received;
-    uint64_t observed_sequence_sent;
-    unsigned int observed_addr_acked : 1;
-    /* Manage path probing logic */
-    uint64_t last_non_path_probing_pn;
-    uint64_t demotion_time;
-    /* Last time a packet was sent on this path. */
-    uint64_t last_sent_time;
-    uint64_t status_sequence_to_receive_next;
-    uint64_t status_sequence_sent_last;
-    /* Last 1-RTT "non path validating" packet received on this path */
+    uint64_t unique_path_id;
+    int cnx_path_index; /* Position of the path in cnx->path */
     /* flags */
     unsigned int mtu_probe_sent : 1;
     unsigned int path_is_published : 1;
@@ -1138,24 +2001,16 @@ typedef struct st_picoquic_path_t {
     unsigned int is_cca_probing_up : 1; /* congestion control algorithm is seeking more bandwidth */
     unsigned int rtt_is_initialized : 1; /* RTT was measured at least once. */
     unsigned int sending_path_cid_blocked_frame : 1; /* Sending a path CID blocked, not acked yet. */
-    
-    /* Management of retransmissions in a path.
-     * The "path_packet" variables are used for the RACK algorithm, per path, to avoid
-     * declaring packets lost just because another path is delivering them faster.
-     * The "number of retransmit" counts the number of unsuccessful retransmissions; it
-     * is reset to zero if a new packet is acknowledged.
-     */
-    uint64_t last_packet_received_at;
-    uint64_t last_loss_event_detected;
-    uint64_t nb_retransmit; /* Number of timeout retransmissions since last ACK */
-    uint64_t total_bytes_lost; /* Sum of length of packet lost on this path */
-    uint64_t nb_losses_found;
-    uint64_t nb_timer_losses;
-    uint64_t nb_spurious; /* Number of spurious retransmissions for the path */
-                                         
-    /* Loss bit data */
-    uint64_t nb_losses_reported;
-    uint64_t q_square;
+
+    /* Congestion control state */
+    uint64_t cwin;
+    uint64_t bytes_in_transit;
+    uint64_t last_sender_limited_time;
+    uint64_t last_cwin_blocked_time;
+    uint64_t last_time_acked_data_frame_sent;
+    void* congestion_alg_state;
+    picoquic_pacing_t pacing;
+
     /* Time measurement */
     uint64_t max_ack_delay;
     uint64_t rtt_sample;
@@ -1176,10 +2031,28 @@ typedef struct st_picoquic_path_t {
     uint64_t max_rtt_estimate_in_period;
     uint64_t min_rtt_estimate_in_period;
 
-
     /* MTU */
     size_t send_mtu;
     size_t send_mtu_max_tried;
+    size_t send_mtu_cached; /* MTU found by previous connections to the peer, probed first */
+
+    /* Management of retransmissions in a path.
+     * The "path_packet" variables are used for the RACK algorithm, per path, to avoid
+     * declaring packets lost just because another path is delivering them faster.
+     * The "number of retransmit" counts the number of unsuccessful retransmissions; it
+     * is reset to zero if a new packet is acknowledged.
+     */
+    uint64_t last_packet_received_at;
+    uint64_t last_loss_event_detected;
+    uint64_t nb_retransmit; /* Number of timeout retransmissions since last ACK */
+    uint64_t total_bytes_lost; /* Sum of length of packet lost on this path */
+    uint64_t nb_losses_found;
+    uint64_t nb_timer_losses;
+    uint64_t nb_spurious; /* Number of spurious retransmissions for the path */
+    uint64_t nb_ce_marked_packets; /* Number of acked packets to which CE marks were attributed */
+    uint64_t ce_marked_bytes; /* Sum of the length of these packets */
+    /* Last time a packet was sent on this path. */
+    uint64_t last_sent_time;
 
     /* Bandwidth measurement */
     uint64_t delivered; /* The total amount of data delivered so far on the path */
@@ -1202,14 +2075,55 @@ typedef struct st_picoquic_path_t {
     uint64_t receive_rate_estimate; /* In bytes per second */
     uint64_t receive_rate_max; /* In bytes per second */
 
-    /* Congestion control state */
-    uint64_t cwin;
-    uint64_t bytes_in_transit;
-    uint64_t last_sender_limited_time;
-    uint64_t last_cwin_blocked_time;
-    uint64_t last_time_acked_data_frame_sent;
-    void* congestion_alg_state;
-    picoquic_pacing_t pacing;
+    /* If using unique path id multipath */
+    picoquic_ack_context_t ack_ctx;
+    picoquic_packet_context_t pkt_ctx;
+
+    /* Cold section */
+    struct sockaddr_storage registered_peer_addr;
+    /* Membership in a congestion manager group */
+    struct st_picoquic_cc_group_t* cc_group;
+    struct st_picoquic_path_t* cc_group_next;
+    struct st_picoquic_path_t* cc_group_previous;
+    /* First exit from slow start, reported in the congestion control telemetry */
+    picoquic_slow_start_exit_reason_t slow_start_exit_reason;
+    uint64_t slow_start_exit_time;
+    picohash_item net_id_hash_item;
+    void* app_path_ctx;
+    /* Manage the transmission of observed addresses */
+    /* TODO: tie management to path/tuple creation. */
+    uint64_t observed_address_received;
+    uint64_t observed_sequence_sent;
+    unsigned int observed_addr_acked : 1;
+    /* Manage path probing logic */
+    uint64_t last_non_path_probing_pn;
+    uint64_t demotion_time;
+    uint64_t status_sequence_to_receive_next;
+    uint64_t status_sequence_sent_last;
+    /* Last 1-RTT "non path validating" packet received on this path */
+    
+    /* Adaptive reordering window, as in RACK (RFC 8985). Spurious retransmissions
+     * increase the packet threshold and the time window used for loss detection.
+     * The values are reset after PICOQUIC_REORDER_WINDOW_PERSIST loss episodes
+     * without spurious retransmission.
+     */
+    uint64_t reorder_packet_threshold;
+    uint64_t reorder_window_mult;
+    uint64_t reorder_window_persist;
+    uint64_t reorder_window_update_time;
+    uint64_t reorder_loss_episode_time;
+    /* Loss probability estimate and preemptive repeat budget, updated once per RTT
+     * by picoquic_update_preemptive_repeat_budget.
+     */
+    uint64_t loss_probability; /* Smoothed, PICOQUIC_LOSS_PROBABILITY_ONE is 100% */
+    uint64_t loss_epoch_start;
+    uint64_t loss_epoch_bytes_sent;
+    uint64_t loss_epoch_bytes_lost;
+    uint64_t preemptive_repeat_budget; /* Bytes that can still be repeated in this epoch */
+                                         
+    /* Loss bit data */
+    uint64_t nb_losses_reported;
+    uint64_t q_square;
 
     /* MTU safety tracking */
     uint64_t nb_mtu_losses;
@@ -1235,6 +2149,8 @@ typedef struct st_picoquic_path_t {
     uint64_t pacing_rate_threshold_high;
     uint64_t receive_rate_threshold_low;
     uint64_t receive_rate_threshold_high;
+    /* Ring of congestion control samples, NULL unless enabled */
+    picoquic_cc_telemetry_t* cc_telemetry;
 
     /* BDP parameters sent by the server to be stored at client */
     uint64_t rtt_min_remote;
@@ -1255,8 +2171,63 @@ typedef struct st_picoquic_crypto_context_t {
     void* aead_decrypt;
     void* pn_enc; /* Used for PN encryption */
     void* pn_dec; /* Used for PN decryption */
+    void* pn_dec_ecb; /* ECB form of pn_dec, used to compute masks in batches. NULL if not AES */
 } picoquic_crypto_context_t;
 
+/* Server side Initial keys of the last Initial DCID, see picoquic_initial_key_cache_get() */
+typedef struct st_picoquic_initial_key_cache_t {
+    int version_index;
+    picoquic_connection_id_t initial_cnxid;
+    picoquic_crypto_context_t crypto_context;
+    uint64_t nb_derived;
+    uint64_t nb_hits;
+} picoquic_initial_key_cache_t;
+
+/* Header protection masks computed in advance for the short header packets
+ * of a GRO batch, see picoquic_prepare_header_masks() */
+#define PICOQUIC_HP_MASK_BATCH_MAX 64
+typedef struct st_picoquic_hp_mask_batch_t {
+    struct st_picoquic_cnx_t* cnx;
+    size_t nb_masks;
+    size_t next_mask;
+    const uint8_t* packet[PICOQUIC_HP_MASK_BATCH_MAX];
+    uint8_t mask[PICOQUIC_HP_MASK_BATCH_MAX * 16];
+} picoquic_hp_mask_batch_t;
+
+/* Summary of the acknowledgements carried by a packet, or by a batch of packets,
+ * for each of the acked paths. The first entries are held in the structure,
+ * which covers the common cases. If more paths are acknowledged, the other
+ * entries are allocated in "path_ack_more", which is freed by
+ * picoquic_packet_data_release. */
+#define PICOQUIC_PACKET_DATA_INLINE_PATHS 2
+
+typedef struct st_picoquic_path_ack_data_t {
+    picoquic_path_t* acked_path; /* path for which ACK was received */
+    uint64_t largest_sent_time; /* Send time of ACKed packet (largest number acked) */
+    uint64_t delivered_prior; /* Amount delivered prior to that packet */
+    uint64_t delivered_time_prior; /* Time last delivery before acked packet sent */
+    uint64_t delivered_sent_prior; /* Time this last delivery packet was sent */
+    uint64_t lost_prior; /* Value of nb_bytes_lost when packet was sent */
+    uint64_t inflight_prior; /* Value of bytes_in_flight when packet was sent */
+    unsigned int rs_is_path_limited; /* Whether the path was app limited when packet was sent */
+    unsigned int rs_is_cwnd_limited;
+    unsigned int is_set;
+    uint64_t data_acked;
+    uint64_t data_ce_marked; /* Part of data_acked in packets to which CE marks were attributed */
+} picoquic_path_ack_data_t;
+
+typedef struct st_picoquic_packet_data_t {
+    uint64_t last_time_stamp_received;
+    uint64_t last_ack_delay; /* ACK Delay in ACK frame */
+    int nb_path_ack;
+    int nb_path_ack_more_alloc;
+    picoquic_path_ack_data_t path_ack[PICOQUIC_PACKET_DATA_INLINE_PATHS];
+    picoquic_path_ack_data_t* path_ack_more;
+} picoquic_packet_data_t;
+
+#define PICOQUIC_PACKET_DATA_PATH_ACK(packet_data, i) (((i) < PICOQUIC_PACKET_DATA_INLINE_PATHS) ? \
+    &(packet_data)->path_ack[(i)] : &(packet_data)->path_ack_more[(i) - PICOQUIC_PACKET_DATA_INLINE_PATHS])
+
 /*
 * Per connection context.
 */
@@ -1325,8 +2296,13 @@ typedef struct st_picoquic_cnx_t {
     unsigned int do_version_negotiation : 1; /* Whether compatible version negotiation is activated */
     unsigned int send_receive_bdp_frame : 1; /* enable sending and receiving BDP frame */
     unsigned int cwin_notified_from_seed : 1; /* cwin was reset from a seeded value */
+    unsigned int is_careful_resume_seeded : 1; /* seed values come from the careful resume cache */
+    unsigned int is_careful_resume_unvalidated : 1; /* jumped to the seed, no proof yet that the path supports it */
+    unsigned int is_fec_negotiated : 1; /* Both ends support the FEC repair frame */
     unsigned int is_datagram_ready : 1; /* Active polling for datagrams */
     unsigned int is_immediate_ack_required : 1; /* Should send an ACK asap */
+    unsigned int is_immediate_ack_pending : 1; /* Should send an IMMEDIATE_ACK frame asap */
+    unsigned int is_ack_frequency_probing : 1; /* Congestion control was probing at the last ACK frequency update */
     unsigned int is_multipath_enabled : 1; /* Unique path ID extension has been negotiated */
     unsigned int is_lost_feedback_notification_required : 1; /* CC algorithm requests lost feedback notification */
     unsigned int is_forced_probe_up_required : 1; /* application wants "probe up" if CC requests it */
@@ -1334,13 +2310,72 @@ typedef struct st_picoquic_cnx_t {
     unsigned int is_address_discovery_receiver : 1; /* receive the address discovery extension */
     unsigned int is_subscribed_to_path_allowed : 1; /* application wants to be advised if it is now possible to create a path */
     unsigned int is_notified_that_path_is_allowed : 1; /* application wants to be advised if it is now possible to create a path */
-    
+    unsigned int is_hibernating : 1; /* Connection is idle and its ephemeral state was released */
+    unsigned int is_redundant_repeat_pending : 1; /* A small packet should be repeated on another path */
+    unsigned int is_ack_batch_queued : 1; /* Connection is in the quic context list of pending ACK batches */
+    unsigned int is_wake_batch_queued : 1; /* Connection waits for reinsertion in the wake list at the end of the receive batch */
+    unsigned int is_handshake_parked : 1; /* TLS handshake waits for an asynchronous operation */
+    unsigned int is_race_secondary : 1; /* Client connection created by the stack to race the application's connection */
+    unsigned int is_race_loser : 1; /* Client connection lost the race, and is being closed */
+    unsigned int is_egress_queued : 1; /* Connection is ready, and waits in the queue of its egress group */
+    unsigned int is_corked : 1; /* Small writes on all streams are coalesced until uncork, see picoquic_cork_cnx */
+    unsigned int is_stream_repeat_from_queue : 1; /* Lost stream data is resent from the retained send queue */
+    unsigned int is_fast_port_rebinding : 1; /* Port changes on the same peer IP keep the current tuple */
+    unsigned int is_stream_data_batch_enabled : 1; /* see picoquic_set_stream_data_batch_delivery */
+    unsigned int is_datagram_batch_enabled : 1; /* see picoquic_set_datagram_batch_delivery */
+    unsigned int is_delivery_batch_queued : 1; /* Connection is in the quic context list of pending deliveries */
+    unsigned int is_backlog_high : 1; /* Send backlog reached the high watermark, and not yet drained to the low */
+
+    /* Hot section. The fields used when sending or receiving each packet are
+     * grouped here, after the flags, so that processing a packet touches a
+     * small number of cache lines. The fields used during the handshake, for
+     * logging or for the management of the connection come after the packet
+     * and ACK contexts. The layout is checked by cnx_layout_test. */
+    picoquic_state_enum cnx_state;
+    picoquic_path_t ** path;
+    int nb_paths;
+    /* Next time sending data is expected */
+    uint64_t next_wake_time;
+    picosplay_node_t cnx_wake_node;
+    picowheel_node_t cnx_wheel_node;
+    /* Wakeup time requested by the application */
+    uint64_t app_wake_time;
+    /* Departure time of the first packet in the last batch prepared, in nanoseconds */
+    uint64_t departure_time_nanosec;
+    /* Liveness detection */
+    uint64_t latest_progress_time; /* last local time at which the connection progressed */
+    uint64_t latest_receive_time; /* last time something was received from the peer */
+    /* Idle timeout in microseconds */
+    uint64_t idle_timeout;
+    /* Call back function and context */
+    picoquic_stream_data_cb_fn callback_fn;
+    void* callback_ctx;
+    /* Congestion algorithm */
+    picoquic_congestion_algorithm_t const* congestion_alg;
+    char const* congestion_alg_option_string;
+    /* Flow control information */
+    uint64_t data_sent;
+    uint64_t data_received;
+    uint64_t maxdata_local; /* Highest value sent to the peer */
+    uint64_t maxdata_local_acked; /* Highest value acked by the peer */
+    uint64_t maxdata_remote; /* Highest value received from the peer */
+    uint64_t max_stream_data_local;
+    /* Encryption and decryption objects of each epoch */
+    picoquic_crypto_context_t crypto_context[PICOQUIC_NUMBER_OF_EPOCHS];
+    /* Sequence and retransmission state */
+    picoquic_packet_context_t pkt_ctx[picoquic_nb_packet_context];
+    /* Acknowledgement state */
+    picoquic_ack_context_t ack_ctx[picoquic_nb_packet_context];
+
+    /* Cold section */
+    /* Queue of ready connections of the egress group, if the egress scheduler is enabled */
+    struct st_picoquic_cnx_t* egress_next;
+    struct st_picoquic_cnx_t* egress_previous;
+    int egress_group;
     /* PMTUD policy */
     picoquic_pmtud_policy_enum pmtud_policy;
     /* Spin bit policy */
     picoquic_spinbit_version_enum spin_policy;
-    /* Idle timeout in microseconds */
-    uint64_t idle_timeout;
     /* Local and remote parameters */
     picoquic_tp_t local_parameters;
     picoquic_tp_t remote_parameters;
@@ -1352,6 +2387,11 @@ typedef struct st_picoquic_cnx_t {
     uint8_t seed_ip_addr_length;
     uint64_t seed_rtt_min;
     uint64_t seed_cwin;
+    /* Delivered bytes and losses on path 0 when the careful resume jump happened */
+    uint64_t careful_resume_delivered;
+    uint64_t careful_resume_losses;
+    /* Weight of the connection in its congestion manager groups, 0 for the default of 1 */
+    uint32_t cc_manager_weight;
     /* Identification of ticket issued to the current connection,
      * and if present of the ticket used to resume the connection.
      * On server this is the unique sequence number of the ticket.
@@ -1366,12 +2406,15 @@ typedef struct st_picoquic_cnx_t {
     char const* alpn;
     /* On clients, receives the maximum 0RTT size accepted by server */
     size_t max_early_data_size;
-    /* Call back function and context */
-    picoquic_stream_data_cb_fn callback_fn;
-    void* callback_ctx;
+    /* On clients, connection racing over another address family.
+     * The race peer is the other connection of the race. The start time is
+     * set on the secondary connection until its Initial flight is started. */
+    struct st_picoquic_cnx_t* race_peer;
+    uint64_t race_start_time;
+    /* Node holding the data passed to the current stream data callback, if any */
+    picoquic_stream_data_node_t* delivered_data_node;
 
     /* connection state, ID, etc. Todo: allow for multiple cnxid */
-    picoquic_state_enum cnx_state;
     picoquic_connection_id_t initial_cnxid;
     picoquic_connection_id_t original_cnxid;
     struct sockaddr_storage registered_icid_addr;
@@ -1391,11 +2434,6 @@ typedef struct st_picoquic_cnx_t {
     uint16_t retry_token_length;
     uint8_t * retry_token;
 
-    /* Next time sending data is expected */
-    uint64_t next_wake_time;
-    picosplay_node_t cnx_wake_node;
-    /* Wakeup time requested by the application */
-    uint64_t app_wake_time;
     /* TLS context, TLS Send Buffer, streams, epochs */
     void* tls_ctx;
     uint64_t crypto_epoch_length_max;
@@ -1405,21 +2443,17 @@ typedef struct st_picoquic_cnx_t {
     uint16_t psk_cipher_suite_id;
 
     picoquic_stream_head_t tls_stream[PICOQUIC_NUMBER_OF_EPOCHS]; /* Separate input/output from each epoch */
-    picoquic_crypto_context_t crypto_context[PICOQUIC_NUMBER_OF_EPOCHS]; /* Encryption and decryption objects */
     picoquic_crypto_context_t crypto_context_old; /* Old encryption and decryption context after key rotation */
     picoquic_crypto_context_t crypto_context_new; /* New encryption and decryption context just before key rotation */
     uint64_t crypto_failure_count;
-    /* Liveness detection */
-    uint64_t latest_progress_time; /* last local time at which the connection progressed */
-    uint64_t latest_receive_time; /* last time something was received from the peer */
     /* Close connection management */
     uint64_t last_close_sent;
-    /* Sequence and retransmission state */
-    picoquic_packet_context_t pkt_ctx[picoquic_nb_packet_context];
-    /* Acknowledgement state */
-    picoquic_ack_context_t ack_ctx[picoquic_nb_packet_context];
     /* Sequence number of the next observed address frame */
     uint64_t observed_number;
+    /* Send backlog and watermarks, see picoquic_set_send_backlog_watermarks */
+    uint64_t send_backlog;
+    uint64_t backlog_high;
+    uint64_t backlog_low;
     /* Statistics */
     uint64_t nb_bytes_queued;
     uint32_t nb_zero_rtt_sent;
@@ -1435,10 +2469,24 @@ typedef struct st_picoquic_cnx_t {
     uint64_t nb_trains_blocked_others;
     uint64_t nb_packets_sent;
     uint64_t nb_packets_logged;
+    uint64_t textlog_window_start; /* Rate limit of the text log, see picoquic_set_textlog_rate_limit */
+    uint64_t textlog_window_lines;
+    uint64_t textlog_nb_suppressed;
+    uint64_t cpu_ticks_receive; /* CPU cost accounting, excluding the application callbacks */
+    uint64_t cpu_ticks_prepare;
+    uint64_t cpu_ticks_app;
     uint64_t nb_retransmission_total;
     uint64_t nb_preemptive_repeat;
+    uint64_t nb_preemptive_repeat_bytes;
+    uint64_t nb_redundant_repeat;
     uint64_t nb_spurious;
+    uint64_t nb_streams_expired; /* Streams reset because data passed its deadline */
+    uint64_t nb_stream_frames_rebuilt; /* Lost stream frames resent from the retained send queue */
+    uint64_t nb_stream_frames_stripped; /* Sent stream frames reduced to metadata in the retransmit queue */
+    uint64_t nb_fec_repairs_sent;
+    uint64_t nb_fec_packets_recovered;
     uint64_t nb_crypto_key_rotations;
+    uint64_t nb_crypto_key_precomputed; /* Next phase keys computed ahead of the key update */
     uint64_t nb_packet_holes_inserted;
     uint64_t max_ack_delay_remote;
     uint64_t max_ack_gap_remote;
@@ -1449,9 +2497,9 @@ typedef struct st_picoquic_cnx_t {
     unsigned int cwin_blocked : 1;
     unsigned int flow_blocked : 1;
     unsigned int stream_blocked : 1;
-    /* Congestion algorithm */
-    picoquic_congestion_algorithm_t const* congestion_alg;
-    char const* congestion_alg_option_string;
+    /* Multipath scheduler, NULL if using the default path selection */
+    picoquic_path_scheduler_t const* path_scheduler;
+    uint64_t redundant_source_path_id;
     /* Management of quality signalling updates */
     uint64_t rtt_update_delta;
     uint64_t pacing_rate_update_delta;
@@ -1463,14 +2511,20 @@ typedef struct st_picoquic_cnx_t {
     /* Data accounting for limiting amplification attacks */
     uint64_t initial_data_received;
     uint64_t initial_data_sent;
-
-    /* Flow control information */
-    uint64_t data_sent;
-    uint64_t data_received;
-    uint64_t maxdata_local; /* Highest value sent to the peer */
-    uint64_t maxdata_local_acked; /* Highest value acked by the peer */
-    uint64_t maxdata_remote; /* Highest value received from the peer */
-    uint64_t max_stream_data_local;
+    uint64_t nb_fast_rebindings; /* Number of port rebindings handled by the fast path */
+
+    /* Flow control information, continued */
+    picoquic_rcv_autotune_t rcv_autotune;
+    /* Memory accounting, see picoquic_get_cnx_memory_usage */
+    size_t memory_used[picoquic_memory_category_max];
+    size_t memory_used_total;
+    size_t memory_used_max;
+    size_t memory_budget; /* zero if no budget */
+    /* Hibernation of idle connections, see picoquic_set_hibernation_delay */
+    uint64_t hibernation_delay; /* zero if no hibernation */
+    uint64_t nb_hibernations;
+    /* Statistics published for other threads, NULL unless enabled, see cnx_stats.c */
+    picoquic_cnx_stats_block_t* stats_block;
     uint64_t max_stream_data_remote;
     uint64_t max_stream_id_bidir_local; /* Highest value sent to the peer */
     uint64_t max_stream_id_bidir_rank_acked; /* Highest rank value acked by the peer */
@@ -1480,6 +2534,7 @@ typedef struct st_picoquic_cnx_t {
     uint64_t max_stream_id_unidir_rank_acked; /* Highest rank value acked by the peer */
     uint64_t max_stream_id_unidir_local_computed;  /* Value computed from stream FIN but not yet sent */
     uint64_t max_stream_id_unidir_remote; /* Highest value received from the peer */
+    picoquic_streams_autotune_t streams_autotune[2]; /* bidir, unidir */
 
     /* Queue for frames waiting to be sent */
     picoquic_misc_frame_header_t* first_misc_frame;
@@ -1487,8 +2542,16 @@ typedef struct st_picoquic_cnx_t {
 
     /* Management of streams */
     picosplay_tree_t stream_tree;
+    /* Index of streams by rank, one per stream type. Streams that do not
+     * fit in the index window are only found through the stream tree. */
+    picoradix_t stream_index[4];
+    size_t nb_streams_not_indexed;
     picoquic_stream_head_t * first_output_stream;
     picoquic_stream_head_t * last_output_stream;
+    uint64_t output_bucket_map[4]; /* Priority levels that have output streams */
+    picoquic_output_bucket_t* output_buckets; /* One per level set in the map, in priority order */
+    size_t nb_output_buckets;
+    size_t output_buckets_allocated;
     uint64_t high_priority_stream_id;
     uint64_t next_stream_id[4];
     uint64_t priority_limit_for_bypass; /* Bypass CC if dtagram or stream priority lower than this, 0 means never */
@@ -1498,8 +2561,13 @@ typedef struct st_picoquic_cnx_t {
 #endif
 
     /* Repeat queue contains packets with data frames that should be
-     * sent according to priority when congestion window opens. */
-    picosplay_tree_t queue_data_repeat_tree;
+     * sent according to priority when congestion window opens,
+     * see picoquic_queue_data_repeat_packet */
+    picoquic_packet_t* data_repeat_first;
+    /* Streams with ranges of lost data to resend from their retained send queue,
+     * see picoquic_queue_stream_frame_repeat */
+    picoquic_stream_head_t* first_repeat_stream;
+    picoquic_stream_head_t* last_repeat_stream;
 
     /* Management of datagram queue (see also active datagram flag)
      * The "conflict" count indicates how many datagrams have been sent while
@@ -1510,6 +2578,12 @@ typedef struct st_picoquic_cnx_t {
      */
     picoquic_misc_frame_header_t* first_datagram;
     picoquic_misc_frame_header_t* last_datagram;
+    picoquic_datagram_ring_t* datagram_ring;
+
+    /* Forward error correction, see fec.c */
+    picoquic_fec_sender_t* fec_sender;
+    picoquic_fec_receiver_t* fec_receiver;
+    uint8_t fec_block_size;
     uint64_t datagram_priority;
     int datagram_conflicts_count;
     int datagram_conflicts_max;
@@ -1518,9 +2592,10 @@ typedef struct st_picoquic_cnx_t {
     uint64_t keep_alive_interval;
 
     /* Management of paths */
-    picoquic_path_t ** path;
-    int nb_paths;
     int nb_path_alloc;
+    /* Index of paths by unique path ID, only built when the number of paths
+     * exceeds PICOQUIC_PATH_INDEX_THRESHOLD */
+    picoradix_t path_index;
     int last_path_polled;
     uint64_t unique_path_id_next;
     picoquic_path_t* nominal_path_for_ack;
@@ -1547,37 +2622,73 @@ typedef struct st_picoquic_cnx_t {
     uint64_t ack_gap_remote;
     uint64_t ack_delay_remote;
     uint64_t ack_reordering_threshold_remote;
+    uint64_t ack_reordering_threshold_local;
+    /* CPU load of the network thread, used by the adaptive ACK frequency */
+    uint64_t ack_cpu_epoch_time;
+    uint64_t ack_cpu_epoch_thread_time;
+    uint64_t ack_cpu_load_permille;
 
     /* Copies of packets received too soon */
     picoquic_stateless_packet_t* first_sooner;
     picoquic_stateless_packet_t* last_sooner;
 
+    /* ACK data aggregated over the current receive batch */
+    picoquic_packet_data_t ack_batch;
+    picoquic_path_t* ack_batch_path;
+    int ack_batch_epoch;
+    uint64_t ack_batch_time;
+    struct st_picoquic_cnx_t* ack_batch_next;
+    uint64_t wake_batch_time;
+    struct st_picoquic_cnx_t* wake_batch_next;
+    /* Data received in the current receive batch, delivered at its end */
+    struct st_picoquic_cnx_t* delivery_batch_next;
+    picoquic_stream_head_t* first_delivery_stream;
+    picoquic_stream_head_t* last_delivery_stream;
+    struct st_picoquic_delivery_batch_t* delivery_batch; /* Allocated on first use */
+
+    /* Asynchronous handshake. The ready flag is set from a worker thread,
+     * which is why it is not part of the bit fields. */
+    volatile int is_async_handshake_ready;
+    size_t parked_epoch;
+
     /* Log handling */
     uint16_t log_unique;
     FILE* f_binlog;
     char* binlog_file_name;
+    struct st_picoquic_binlog_recorder_t* binlog_recorder; /* Records kept in memory, see picoquic_set_log_policy */
+    struct st_picoquic_binlog_block_t* binlog_block; /* Block being filled, if the binlog is compressed */
+    picoquic_qlog_stream_t* qlog_stream; /* Records converted to qlog as they are written, see picoquic_set_qlog */
+    unsigned int is_log_policy_checked : 1;
+    unsigned int is_log_policy_rejected : 1;
     void (*memlog_call_back)(picoquic_cnx_t* cnx, picoquic_path_t* path, void* v_memlog, int op_code, uint64_t current_time);
     void *memlog_ctx;
 } picoquic_cnx_t;
 
-typedef struct st_picoquic_packet_data_t {
-    uint64_t last_time_stamp_received;
-    uint64_t last_ack_delay; /* ACK Delay in ACK frame */
-    int nb_path_ack;
-    struct {
-        picoquic_path_t* acked_path; /* path for which ACK was received */
-        uint64_t largest_sent_time; /* Send time of ACKed packet (largest number acked) */
-        uint64_t delivered_prior; /* Amount delivered prior to that packet */
-        uint64_t delivered_time_prior; /* Time last delivery before acked packet sent */
-        uint64_t delivered_sent_prior; /* Time this last delivery packet was sent */
-        uint64_t lost_prior; /* Value of nb_bytes_lost when packet was sent */
-        uint64_t inflight_prior; /* Value of bytes_in_flight when packet was sent */
-        unsigned int rs_is_path_limited; /* Whether the path was app limited when packet was sent */
-        unsigned int rs_is_cwnd_limited;
-        unsigned int is_set;
-        uint64_t data_acked;
-    } path_ack[PICOQUIC_NB_PATH_TARGET];
-} picoquic_packet_data_t;
+/* The binary log is either written to a file, converted to qlog as it is written,
+ * or kept in memory by the flight recorder */
+#define PICOQUIC_CNX_IS_BINLOGGING(cnx) ((cnx)->f_binlog != NULL || (cnx)->qlog_stream != NULL || (cnx)->binlog_recorder != NULL)
+
+/* Lean build. If PICOQUIC_LEAN is defined, multipath, the text log and the
+ * experimental extensions (address discovery, BDP frame) are compiled out.
+ * Their transport parameters are removed from the local parameters, so they
+ * are never negotiated, and the tests below become compile time constants:
+ * the corresponding branches disappear from the packet processing code.
+ */
+#ifdef PICOQUIC_LEAN
+#define PICOQUIC_CNX_IS_MULTIPATH(cnx) 0
+#define PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_PROVIDER(cnx) 0
+#define PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_RECEIVER(cnx) 0
+#define PICOQUIC_CNX_IS_BDP_FRAME_ENABLED(cnx) 0
+#define PICOQUIC_QUIC_IS_TEXT_LOGGING(quic) 0
+#define PICOQUIC_LEAN_TRANSPORT_PARAMETERS(tp) { (tp)->is_multipath_enabled = 0; (tp)->address_discovery_mode = 0; (tp)->enable_bdp_frame = 0; }
+#else
+#define PICOQUIC_CNX_IS_MULTIPATH(cnx) ((cnx)->is_multipath_enabled)
+#define PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_PROVIDER(cnx) ((cnx)->is_address_discovery_provider)
+#define PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_RECEIVER(cnx) ((cnx)->is_address_discovery_receiver)
+#define PICOQUIC_CNX_IS_BDP_FRAME_ENABLED(cnx) ((cnx)->send_receive_bdp_frame)
+#define PICOQUIC_QUIC_IS_TEXT_LOGGING(quic) ((quic)->F_log != NULL)
+#define PICOQUIC_LEAN_TRANSPORT_PARAMETERS(tp)
+#endif
 
 /* Load the stash of retry tokens. */
 int picoquic_load_token_file(picoquic_quic_t* quic, char const * token_file_name);
@@ -1608,6 +2719,10 @@ void picoquic_register_path(picoquic_cnx_t* cnx, picoquic_path_t * path_x);
 int picoquic_find_incoming_path(picoquic_cnx_t* cnx, picoquic_packet_header* ph,
     struct sockaddr* addr_from, struct sockaddr* addr_to, int if_index_to,
     uint64_t current_time, int* p_path_id, int* path_is_not_allocated);
+/* PMTUD: check whether a probe is needed, and format the next probe. */
+picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t* cnx, picoquic_path_t* path_x);
+size_t picoquic_prepare_mtu_probe(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    size_t header_length, size_t checksum_length, uint8_t* bytes, size_t bytes_max);
 /* Prepare packet containing only path control frames. */
 int picoquic_prepare_path_control_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_tuple_t* tuple,
     picoquic_packet_t* packet, uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
@@ -1622,10 +2737,12 @@ void picoquic_select_next_path_tuple(picoquic_cnx_t* cnx, uint64_t current_time,
 int picoquic_renew_connection_id(picoquic_cnx_t* cnx, int path_id);
 void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index);
 void picoquic_demote_path(picoquic_cnx_t* cnx, int path_index, uint64_t current_time, uint64_t reason, char const * phrase);
+/* Force the next loss check on all the packet contexts, see loss_check_time */
+void picoquic_reset_loss_check(picoquic_cnx_t* cnx);
 void picoquic_retransmit_demoted_path(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time);
 void picoquic_queue_retransmit_on_ack(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t current_time);
 void picoquic_delete_abandoned_paths(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t * next_wake_time);
-void picoquic_set_tuple_challenge(picoquic_tuple_t* tuple, uint64_t current_time, int use_constant_challenges);
+void picoquic_set_tuple_challenge(picoquic_quic_t* quic, picoquic_tuple_t* tuple, uint64_t current_time);
 void picoquic_set_path_challenge(picoquic_cnx_t* cnx, int path_id, uint64_t current_time);
 int picoquic_find_path_by_address(picoquic_cnx_t* cnx, const struct sockaddr* addr_local, const struct sockaddr* addr_peer, int* partial_match);
 int picoquic_find_path_by_unique_id(picoquic_cnx_t* cnx, uint64_t unique_path_id);
@@ -1641,6 +2758,8 @@ picoquic_remote_cnxid_stash_t* picoquic_find_or_create_remote_cnxid_stash(picoqu
 int picoquic_init_cnxid_stash(picoquic_cnx_t* cnx);
 
 uint64_t picoquic_add_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* remote_cnxid_stash, uint64_t retire_before_next, const uint64_t sequence, const uint8_t cid_length, const uint8_t* cnxid_bytes, const uint8_t* secret_bytes, picoquic_remote_cnxid_t** pstashed);
+picoquic_remote_cnxid_t* picoquic_append_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* remote_cnxid_stash,
+    uint64_t sequence, const picoquic_connection_id_t* cnx_id, const uint8_t* secret_bytes);
 
 uint64_t picoquic_stash_remote_cnxid(picoquic_cnx_t * cnx, uint64_t retire_before_next,
     const uint64_t unique_path_id, const uint64_t sequence, const uint8_t cid_length, const uint8_t * cnxid_bytes,
@@ -1652,6 +2771,7 @@ picoquic_remote_cnxid_t* picoquic_remove_stashed_cnxid(picoquic_cnx_t* cnx, uint
     picoquic_remote_cnxid_t* previous);
 
 picoquic_remote_cnxid_t* picoquic_get_cnxid_from_stash(picoquic_remote_cnxid_stash_t* stash);
+picoquic_remote_cnxid_t* picoquic_find_cnxid_in_stash(picoquic_remote_cnxid_stash_t* stash, uint64_t sequence);
 picoquic_remote_cnxid_t* picoquic_obtain_stashed_cnxid(picoquic_cnx_t* cnx, uint64_t unique_path_id);
 void picoquic_dereference_stashed_cnxid(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int is_deleting_cnx);
 uint64_t picoquic_remove_not_before_from_stash(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* cnxid_stash, uint64_t not_before, uint64_t current_time);
@@ -1667,6 +2787,8 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx, picoq
     picoquic_packet_t* p, int should_free,
     int add_to_data_repeat_queue);
 void picoquic_dequeue_retransmitted_packet(picoquic_cnx_t* cnx, picoquic_packet_context_t* pkt_ctx, picoquic_packet_t* p);
+picoquic_packet_t* picoquic_packet_index_find(picoquic_packet_index_t* index, uint64_t sequence_number);
+void picoquic_packet_index_free(picoquic_packet_index_t* index);
 
 /* Reset the connection context, e.g. after retry */
 int picoquic_reset_cnx(picoquic_cnx_t* cnx, uint64_t current_time);
@@ -1681,12 +2803,19 @@ int picoquic_connection_error_ex(picoquic_cnx_t* cnx, uint64_t local_error, uint
 
 void picoquic_connection_disconnect(picoquic_cnx_t* cnx);
 
+/* Connection racing, called before preparing packets for a racing connection */
+void picoquic_race_update(picoquic_cnx_t* cnx, uint64_t current_time);
+
 /* Connection context retrieval functions */
 picoquic_cnx_t* picoquic_cnx_by_id(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id, struct st_picoquic_local_cnxid_t ** l_cid_sequence);
 picoquic_cnx_t* picoquic_cnx_by_net(picoquic_quic_t* quic, const struct sockaddr* addr);
 picoquic_cnx_t* picoquic_cnx_by_icid(picoquic_quic_t* quic, picoquic_connection_id_t* icid,
     const struct sockaddr* addr);
 picoquic_cnx_t* picoquic_cnx_by_secret(picoquic_quic_t* quic, const uint8_t* reset_secret, const struct sockaddr* addr);
+void picoquic_reset_filter_add(picoquic_quic_t* quic, const uint8_t* reset_secret);
+void picoquic_reset_filter_remove(picoquic_quic_t* quic, const uint8_t* reset_secret);
+int picoquic_reset_filter_check(picoquic_quic_t* quic, const uint8_t* reset_secret);
+void picoquic_reset_filter_release(picoquic_quic_t* quic);
 
 /* Pacing implementation */
 void picoquic_pacing_init(picoquic_pacing_t* pacing, uint64_t current_time);
@@ -1696,6 +2825,8 @@ void picoquic_update_pacing_parameters(picoquic_pacing_t* pacing, double pacing_
     picoquic_path_t* signalled_path);
 void picoquic_update_pacing_window(picoquic_pacing_t* pacing, int slow_start, uint64_t cwin, size_t send_mtu, uint64_t smoothed_rtt, picoquic_path_t * signalled_path);
 void picoquic_update_pacing_data_after_send(picoquic_pacing_t * pacing, size_t length, size_t send_mtu, uint64_t current_time);
+void picoquic_set_pacing_data_horizon(picoquic_pacing_t* pacing, uint64_t horizon_microsec);
+size_t picoquic_get_pacing_data_budget(picoquic_pacing_t* pacing, uint64_t current_time);
 
 /* Reset the pacing data after CWIN is updated */
 void picoquic_update_pacing_data(picoquic_cnx_t* cnx, picoquic_path_t * path_x, int slow_start);
@@ -1710,6 +2841,12 @@ int picoquic_issue_path_quality_update(picoquic_cnx_t* cnx, picoquic_path_t* pat
 /* Next time is used to order the list of available connections,
         * so ready connections are polled first */
 void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx, uint64_t next_time);
+/* Update the clock cache with the time passed to the packet APIs, see picoquic_set_clock_cache */
+void picoquic_cache_quic_time(picoquic_quic_t* quic, uint64_t current_time);
+/* Align a wake time that is at least one timer slack away to the next slot boundary,
+ * but not past the loss detection or PTO deadline of the connection */
+uint64_t picoquic_align_wake_time(picoquic_quic_t* quic, uint64_t wake_time, uint64_t current_time,
+    uint64_t loss_deadline);
 
 /* Integer parsing macros */
 #define PICOPARSE_16(b) ((((uint16_t)(b)[0]) << 8) | (uint16_t)((b)[1]))
@@ -1717,6 +2854,13 @@ void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
 #define PICOPARSE_32(b) ((((uint32_t)PICOPARSE_16(b)) << 16) | (uint32_t)PICOPARSE_16((b) + 2))
 #define PICOPARSE_64(b) ((((uint64_t)PICOPARSE_32(b)) << 32) | (uint64_t)PICOPARSE_32((b) + 4))
 
+/* Varint parsing without a loop over the octets. The value is extracted from a
+ * single 8 octets big endian load, shifted and masked according to the length
+ * code in the first octet. Only usable if at least 8 octets are available. */
+extern const uint8_t picoquic_varint_shift[4];
+extern const uint64_t picoquic_varint_mask[4];
+#define PICOPARSE_VARINT_8(b) ((PICOPARSE_64(b) >> picoquic_varint_shift[(b)[0] >> 6]) & picoquic_varint_mask[(b)[0] >> 6])
+
 /* Integer formatting functions */
 void picoformat_16(uint8_t* bytes, uint16_t n16);
 void picoformat_24(uint8_t* bytes, uint32_t n24);
@@ -1727,6 +2871,7 @@ size_t picoquic_varint_encode(uint8_t* bytes, size_t max_bytes, uint64_t n64);
 void picoquic_varint_encode_16(uint8_t* bytes, uint16_t n16);
 size_t picoquic_varint_decode(const uint8_t* bytes, size_t max_bytes, uint64_t* n64);
 const uint8_t* picoquic_frames_varint_decode(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* n64);
+const uint8_t* picoquic_frames_varint_decode_batch(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* values, size_t nb_values);
 const uint8_t* picoquic_frames_varint_skip(const uint8_t* bytes, const uint8_t* bytes_max);
 size_t picoquic_varint_skip(const uint8_t* bytes);
 
@@ -1773,6 +2918,7 @@ void picoquic_update_payload_length(
 
 size_t picoquic_get_checksum_length(picoquic_cnx_t* cnx, picoquic_epoch_enum is_cleartext_mode);
 
+void picoquic_apply_header_mask(uint8_t* send_buffer, size_t pn_offset, uint8_t first_mask, const uint8_t* mask_bytes);
 void picoquic_protect_packet_header(uint8_t* send_buffer, size_t pn_offset, uint8_t first_mask, void* pn_enc);
 
 size_t picoquic_protect_packet(picoquic_cnx_t* cnx, picoquic_packet_type_enum ptype, uint8_t* bytes, uint64_t sequence_number, size_t length, size_t header_length, uint8_t* send_buffer, size_t send_buffer_max, void* aead_context, void* pn_enc, 
@@ -1807,6 +2953,9 @@ int picoquic_parse_header_and_decrypt(
     size_t * consumed,
     int * new_context_created);
 
+picoquic_cnx_t* picoquic_cnx_by_id_cached(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id,
+    struct st_picoquic_local_cnxid_t** l_cid);
+
 /* Shortcuts to packet numbers, last ack, last ack time.
  */
 uint64_t picoquic_get_sequence_number(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_context_enum pc);
@@ -1837,12 +2986,15 @@ int picoquic_check_sack_list(picoquic_sack_list_t* sack,
 
 picoquic_sack_item_t* picoquic_process_ack_of_ack_range(picoquic_sack_list_t* first_sack, picoquic_sack_item_t* previous, uint64_t start_of_range, uint64_t end_of_range);
 void picoquic_update_ack_horizon(picoquic_sack_list_t* sack_list, uint64_t current_time);
+void picoquic_sack_list_compact(picoquic_sack_list_t* sack_list, size_t nb_ranges_max);
 
 /* Return the first ACK item in the list */
 picoquic_sack_item_t* picoquic_sack_first_item(picoquic_sack_list_t* sack_list);
 picoquic_sack_item_t* picoquic_sack_last_item(picoquic_sack_list_t* sack_list);
-picoquic_sack_item_t* picoquic_sack_next_item(picoquic_sack_item_t * sack);
-picoquic_sack_item_t* picoquic_sack_previous_item(picoquic_sack_item_t* sack);
+picoquic_sack_item_t* picoquic_sack_next_item(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack);
+picoquic_sack_item_t* picoquic_sack_previous_item(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack);
+picoquic_sack_item_t* picoquic_sack_find_range_below_number(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* previous,
+    uint64_t pn64);
 int picoquic_sack_insert_item(picoquic_sack_list_t* sack_list, uint64_t range_min, 
     uint64_t range_max, uint64_t current_time);
 
@@ -1877,6 +3029,15 @@ void picoquic_sack_item_record_reset(picoquic_sack_list_t* sack_list, picoquic_s
 size_t picoquic_sack_list_size(picoquic_sack_list_t* first_sack);
 
 void picoquic_record_ack_packet_data(picoquic_packet_data_t* packet_data, picoquic_packet_t* acked_packet);
+void picoquic_packet_data_release(picoquic_packet_data_t* packet_data);
+void picoquic_ack_batch_add(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int epoch,
+    uint64_t current_time, picoquic_packet_data_t* packet_data);
+void picoquic_ack_batch_flush(picoquic_cnx_t* cnx);
+void picoquic_ack_batch_forget_cnx(picoquic_cnx_t* cnx);
+void picoquic_wake_batch_forget_cnx(picoquic_cnx_t* cnx);
+void picoquic_delivery_batch_flush(picoquic_cnx_t* cnx);
+void picoquic_delivery_batch_forget_cnx(picoquic_cnx_t* cnx);
+void picoquic_delivery_batch_forget_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
 
 void picoquic_init_packet_ctx(picoquic_cnx_t* cnx, picoquic_packet_context_t* pkt_ctx, picoquic_packet_context_enum pc);
 
@@ -1903,6 +3064,13 @@ uint64_t picoquic_current_retransmit_timer(picoquic_cnx_t* cnx, picoquic_path_t*
 void picoquic_update_path_rtt(picoquic_cnx_t* cnx, picoquic_path_t * old_path, picoquic_path_t* path_x, int epoch,
     uint64_t send_time, uint64_t current_time, uint64_t ack_delay, uint64_t time_stamp);
 
+/* Update the path bandwidth estimates upon receiving an acknowledgement */
+void picoquic_estimate_path_bandwidth(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t send_time,
+    uint64_t delivered_prior, uint64_t delivered_time_prior, uint64_t delivered_sent_prior,
+    uint64_t delivery_time, uint64_t current_time, int rs_is_path_limited);
+void picoquic_estimate_max_path_bandwidth(picoquic_cnx_t* cnx, picoquic_path_t* path_x, uint64_t send_time,
+    uint64_t delivery_time, uint64_t current_time);
+
 /* stream management */
 picoquic_stream_head_t* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t stream_id);
 picoquic_stream_head_t* picoquic_create_missing_streams(picoquic_cnx_t* cnx, uint64_t stream_id, int is_remote);
@@ -1915,6 +3083,9 @@ picoquic_stream_head_t * picoquic_stream_from_node(picosplay_node_t * node);
 void picoquic_insert_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream);
 void picoquic_remove_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream);
 void picoquic_reorder_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+void picoquic_requeue_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+void picoquic_promote_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+void picoquic_release_output_buckets(picoquic_cnx_t* cnx);
 picoquic_stream_head_t * picoquic_first_stream(picoquic_cnx_t * cnx);
 picoquic_stream_head_t * picoquic_last_stream(picoquic_cnx_t * cnx);
 picoquic_stream_head_t * picoquic_next_stream(picoquic_stream_head_t * stream);
@@ -1942,13 +3113,23 @@ void picoquic_update_max_stream_ID_local(picoquic_cnx_t* cnx, picoquic_stream_he
 int picoquic_check_frame_needs_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes,
     size_t bytes_max, picoquic_packet_type_enum p_type,
     int* no_need_to_repeat, int* do_not_detect_spurious, int *is_preemptive_needed);
+/* Reasons for preemptive repeat, set by picoquic_check_frame_needs_repeat in
+ * is_preemptive_needed. Tails of messages are only repeated if the path is lossy.
+ */
+#define PICOQUIC_PREEMPTIVE_STREAM_FIN 1 /* Stream frame of a stream for which FIN was sent */
+#define PICOQUIC_PREEMPTIVE_MESSAGE_TAIL 2 /* Last frame of the data queued on a stream */
+#define PICOQUIC_PREEMPTIVE_HANDSHAKE_TAIL 4 /* Handshake done or crypto frame */
+#define PICOQUIC_LOSS_PROBABILITY_ONE 0x10000
+#define PICOQUIC_PREEMPTIVE_LOSSY_THRESHOLD (PICOQUIC_LOSS_PROBABILITY_ONE/100)
+#define PICOQUIC_PREEMPTIVE_BUDGET_MIN_PACKETS 4
+void picoquic_update_preemptive_repeat_budget(picoquic_path_t* path_x, uint64_t current_time);
+int picoquic_preemptive_repeat_mask(picoquic_path_t* path_x);
 uint8_t* picoquic_format_available_stream_frames(picoquic_cnx_t* cnx, picoquic_path_t * path_x,
     uint8_t* bytes_next, uint8_t* bytes_max, uint64_t current_priority,
     int* more_data, int* is_pure_ack, int* stream_tried_and_failed, int* ret);
 
 /* Handling of stream_data_frames that need repeating.
  */
-void picoquic_queue_data_repeat_init(picoquic_cnx_t* cnx);
 void picoquic_queue_data_repeat_packet(
     picoquic_cnx_t* cnx, picoquic_packet_t* packet);
 void picoquic_dequeue_data_repeat_packet(
@@ -1959,6 +3140,38 @@ uint8_t* picoquic_copy_stream_frame_for_retransmit(
     uint8_t* bytes_next, uint8_t* bytes_max);
 uint8_t* picoquic_copy_stream_frames_for_retransmit(picoquic_cnx_t* cnx,
     uint8_t* bytes_next, uint8_t* bytes_max, uint64_t current_priority, int* more_data, int* is_pure_ack);
+/* Resending lost stream data from the retained send queue, when
+ * is_stream_repeat_from_queue is set. picoquic_queue_stream_frame_repeat
+ * returns 0 if the frame will be rebuilt from the stream, so the packet
+ * does not need to be kept in the data repeat queue. Packets queued for
+ * retransmit only keep the metadata of the retained stream frames, see
+ * picoquic_strip_retained_stream_data.
+ */
+void picoquic_stream_retain_sent_node(picoquic_stream_head_t* stream,
+    picoquic_stream_queue_node_t* node, uint64_t stream_offset);
+void picoquic_stream_release_acked_data(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+void picoquic_stream_retained_free(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
+int picoquic_stream_copy_retained(picoquic_stream_head_t* stream, uint64_t offset, uint8_t* bytes, size_t length);
+int picoquic_queue_network_input(picoquic_quic_t* quic, picoquic_cnx_t* cnx, picosplay_tree_t* tree, uint64_t consumed_offset,
+    uint64_t frame_data_offset, const uint8_t* bytes, size_t length, int is_last_frame, picoquic_stream_data_node_t* received_data, int* new_data_available);
+int picoquic_queue_stream_frame_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t bytes_max);
+int picoquic_is_stream_metadata_frame(const uint8_t* bytes, size_t bytes_max);
+int picoquic_queue_stream_metadata_repeat(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t bytes_max);
+uint8_t* picoquic_format_stream_metadata_frame(uint8_t* bytes, uint8_t* bytes_max,
+    uint64_t stream_id, uint64_t offset, size_t data_length, int fin);
+const uint8_t* picoquic_parse_stream_metadata_frame(const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t* stream_id, uint64_t* offset, size_t* data_length, int* fin);
+size_t picoquic_strip_retained_stream_data(picoquic_cnx_t* cnx, picoquic_packet_t* packet);
+picoquic_stream_head_t* picoquic_first_repeat_stream(picoquic_cnx_t* cnx);
+uint8_t* picoquic_copy_stream_repeats_for_retransmit(picoquic_cnx_t* cnx,
+    uint8_t* bytes_next, uint8_t* bytes_max, uint64_t current_priority, int* more_data, int* is_pure_ack);
+/* Accounting of the send backlog. The watermark events are issued when the backlog
+ * of the stream or of the connection crosses them. picoquic_send_backlog_discard
+ * removes the data of a reset stream, without stream events.
+ */
+void picoquic_send_backlog_add(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint64_t length);
+void picoquic_send_backlog_remove(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint64_t length);
+void picoquic_send_backlog_discard(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
 /* Processing of packets considered lost: queueing frames
  * that need to be repeated as "misc" frames, setting the
  * flag `add_to_data_repeat_queue` if the packet contains stream
@@ -2015,16 +3228,36 @@ const uint8_t* picoquic_decode_crypto_hs_frame(picoquic_cnx_t* cnx, const uint8_
     const uint8_t* bytes_max, picoquic_stream_data_node_t* received_data, int epoch);
 uint8_t* picoquic_format_crypto_hs_frame(picoquic_stream_head_t* stream, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 uint8_t* picoquic_format_ack_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, uint64_t current_time, picoquic_packet_context_enum pc, int is_opportunistic);
+uint8_t* picoquic_format_ack_frame_in_context(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
+    int* more_data, uint64_t current_time, picoquic_ack_context_t* ack_ctx, int* need_time_stamp,
+    uint64_t multipath_sequence, int is_opportunistic);
 uint8_t* picoquic_format_connection_close_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 uint8_t* picoquic_format_application_close_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 uint8_t* picoquic_format_required_max_stream_data_frames(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 uint8_t* picoquic_format_max_data_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, uint64_t maxdata_increase);
 uint8_t* picoquic_format_max_stream_data_frame(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, uint64_t new_max_data);
+uint64_t picoquic_stream_new_max_data(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
 uint64_t picoquic_cc_increased_window(picoquic_cnx_t* cnx, uint64_t previous_window); /* Trigger sending more data if window increases */
+int picoquic_bbr_is_probing(picoquic_path_t* path_x); /* BBR is in startup or probing for bandwidth */
+void picoquic_adaptive_ack_frequency_update(picoquic_cnx_t* cnx, uint64_t current_time);
 uint8_t* picoquic_format_max_streams_frame_if_needed(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 void picoquic_stream_data_node_recycle(picoquic_stream_data_node_t* stream_data);
 picoquic_stream_data_node_t* picoquic_stream_data_node_alloc(picoquic_quic_t* quic);
+picoquic_stream_data_node_t* picoquic_stream_data_node_alloc_ex(picoquic_quic_t* quic, size_t length);
 void picoquic_clear_stream(picoquic_stream_head_t* stream);
+void picoquic_memory_charge(picoquic_cnx_t* cnx, picoquic_memory_category_enum category, size_t size);
+void picoquic_memory_discharge(picoquic_cnx_t* cnx, picoquic_memory_category_enum category, size_t size);
+uint64_t picoquic_memory_budget_credit(picoquic_cnx_t* cnx, uint64_t credit_increase);
+uint64_t picoquic_cnx_max_data_increase(picoquic_cnx_t* cnx);
+int picoquic_memory_budget_exceeded(picoquic_cnx_t* cnx);
+/* Hibernation of idle connections */
+int picoquic_is_cnx_quiet(picoquic_cnx_t* cnx);
+void picoquic_hibernate_cnx(picoquic_cnx_t* cnx);
+void picoquic_rehydrate_cnx(picoquic_cnx_t* cnx);
+void picoquic_stream_queue_node_free(picoquic_cnx_t* cnx, picoquic_stream_queue_node_t* stream_data);
+void picoquic_stream_deadlines_free(picoquic_stream_head_t* stream);
+int picoquic_stream_data_is_expired(picoquic_stream_head_t* stream, uint64_t offset, uint64_t length, uint64_t current_time);
+void picoquic_stream_deadline_expire(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream);
 void picoquic_delete_stream(picoquic_cnx_t * cnx, picoquic_stream_head_t * stream);
 picoquic_local_cnxid_list_t* picoquic_find_or_create_local_cnxid_list(picoquic_cnx_t* cnx, uint64_t unique_path_id, int do_create);
 picoquic_local_cnxid_t* picoquic_create_local_cnxid(picoquic_cnx_t* cnx,
@@ -2046,18 +3279,38 @@ uint8_t* picoquic_format_blocked_frames(picoquic_cnx_t* cnx, uint8_t* bytes, uin
 int picoquic_queue_retire_connection_id_frame(picoquic_cnx_t * cnx, uint64_t unique_path_id, uint64_t sequence);
 int picoquic_queue_new_token_frame(picoquic_cnx_t * cnx, uint8_t * token, size_t token_length);
 uint8_t* picoquic_format_one_blocked_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, picoquic_stream_head_t* stream);
-uint8_t* picoquic_format_first_misc_or_dg_frame(uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack,
+uint8_t* picoquic_format_first_misc_or_dg_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack,
     picoquic_misc_frame_header_t* misc_frame, picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last);
 picoquic_misc_frame_header_t* picoquic_find_first_misc_frame(picoquic_cnx_t* cnx, picoquic_packet_context_enum pc);
 uint8_t* picoquic_format_misc_frames_in_context(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
     int* more_data, int* is_pure_ack, picoquic_packet_context_enum pc);
 int picoquic_queue_misc_or_dg_frame(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, const uint8_t* bytes, size_t length, int is_pure_ack, picoquic_packet_context_enum pc);
 void picoquic_purge_misc_frames_after_ready(picoquic_cnx_t* cnx);
-void picoquic_delete_misc_or_dg(picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, picoquic_misc_frame_header_t* frame);
+void picoquic_delete_misc_or_dg(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, picoquic_misc_frame_header_t* frame);
 void picoquic_clear_ack_ctx(picoquic_ack_context_t* ack_ctx);
 void picoquic_reset_ack_context(picoquic_ack_context_t* ack_ctx);
 int picoquic_queue_handshake_done_frame(picoquic_cnx_t* cnx);
 uint8_t* picoquic_format_first_datagram_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
+uint8_t* picoquic_format_ring_datagram_frames(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
+    int* more_data, int* is_pure_ack, uint64_t current_time);
+void picoquic_datagram_ring_free(picoquic_cnx_t* cnx);
+
+/* Forward error correction */
+void picoquic_fec_free(picoquic_cnx_t* cnx);
+void picoquic_fec_add_source(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_t* packet,
+    size_t header_length, size_t payload_length, size_t checksum_overhead, uint64_t current_time);
+uint8_t* picoquic_format_fec_repair_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max,
+    int* more_data, int* is_pure_ack);
+const uint8_t* picoquic_skip_fec_repair_frame(const uint8_t* bytes, const uint8_t* bytes_max);
+const uint8_t* picoquic_decode_fec_repair_frame(picoquic_cnx_t* cnx, const uint8_t* bytes, const uint8_t* bytes_max);
+int picoquic_fec_incoming_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_header* ph,
+    const uint8_t* payload, struct sockaddr* addr_from, struct sockaddr* addr_to, uint64_t current_time);
+uint64_t picoquic_fec_recovery_deadline(picoquic_cnx_t* cnx, picoquic_packet_t* old_p);
+int picoquic_is_packet_ack_eliciting(picoquic_packet_t* packet);
+/* Adaptive reordering window, see loss_recovery.c */
+void picoquic_reorder_window_on_spurious(picoquic_path_t* path_x, uint64_t reorder_gap, uint64_t current_time);
+void picoquic_reorder_window_on_loss(picoquic_path_t* path_x, uint64_t current_time);
+uint64_t picoquic_reorder_window_delay(picoquic_path_t* path_x);
 uint8_t* picoquic_format_ready_datagram_frame(picoquic_cnx_t* cnx, picoquic_path_t * path_x, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack, int* ret);
 uint8_t* picoquic_decode_datagram_frame_header(uint8_t* bytes, const uint8_t* bytes_max,
     uint8_t* frame_id, uint64_t* length);
@@ -2065,6 +3318,7 @@ const uint8_t* picoquic_parse_ack_frequency_frame(const uint8_t* bytes, const ui
     uint64_t* seq, uint64_t* packets, uint64_t* microsec, uint8_t * ignore_order, uint64_t *reordering_threshold);
 uint8_t* picoquic_format_ack_frequency_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data);
 uint8_t* picoquic_format_immediate_ack_frame(uint8_t* bytes, uint8_t* bytes_max, int* more_data);
+uint8_t* picoquic_format_immediate_ack_if_pending(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, int* is_pure_ack);
 uint8_t* picoquic_format_time_stamp_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, int* more_data, uint64_t current_time);
 size_t picoquic_encode_time_stamp_length(picoquic_cnx_t* cnx, uint64_t current_time);
 uint8_t* picoquic_format_bdp_frame(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max, picoquic_path_t* path_x, int* more_data, int * is_pure_ack);
@@ -2111,7 +3365,7 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
 int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mode,
     uint8_t* bytes, size_t bytes_max, size_t* consumed);
 
-picoquic_misc_frame_header_t* picoquic_create_misc_frame(const uint8_t* bytes, size_t length, int is_pure_ack,
+picoquic_misc_frame_header_t* picoquic_create_misc_frame(picoquic_quic_t* quic, const uint8_t* bytes, size_t length, int is_pure_ack,
     picoquic_packet_context_enum pc);
 
 /* Supported version upgrade.
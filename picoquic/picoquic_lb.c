@@ -147,90 +147,43 @@ void picoquic_lb_compat_cid_generate(picoquic_quic_t* quic, picoquic_connection_
     }
 }
 
-static uint64_t picoquic_lb_compat_cid_verify_clear(picoquic_quic_t* quic,
-    picoquic_load_balancer_cid_context_t* lb_ctx, picoquic_connection_id_t const* cnx_id)
+/* The decoding of server IDs is implemented in picoquic_lb_decode.c, which
+ * load balancers can use without the rest of the stack.
+ */
+uint64_t picoquic_lb_compat_cid_verify(picoquic_quic_t* quic, void* cnx_id_cb_data, picoquic_connection_id_t const* cnx_id)
 {
-    uint64_t s_id64 = 0;
+    uint64_t server_id64 = UINT64_MAX;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(quic);
+#endif
 
-    for (size_t i = 0; i < lb_ctx->server_id_length; i++) {
-        s_id64 <<= 8;
-        s_id64 += cnx_id->id[i + 1];
-    }
+    (void)picoquic_lb_compat_cid_verify_batch(cnx_id_cb_data, cnx_id, 1, &server_id64);
 
-    return s_id64;
+    return server_id64;
 }
 
-static uint64_t picoquic_lb_compat_cid_verify_stream_cipher(picoquic_quic_t* quic,
-    picoquic_load_balancer_cid_context_t* lb_ctx, picoquic_connection_id_t const* cnx_id)
+size_t picoquic_lb_compat_cid_verify_batch(void* cnx_id_cb_data, picoquic_connection_id_t const* cnx_id,
+    size_t nb_cnx_id, uint64_t* server_id64)
 {
-    size_t id_offset = ((size_t)1) + lb_ctx->nonce_length;
-    uint64_t s_id64 = 0;
-    picoquic_connection_id_t target = *cnx_id;
-    /* First pass -- obtain intermediate server ID */
-    picoquic_lb_compat_cid_one_pass_stream(lb_ctx->cid_encryption_context, target.id + 1, lb_ctx->nonce_length,
-        target.id + id_offset, lb_ctx->server_id_length);
-    /* Second pass -- obtain nonce */
-    picoquic_lb_compat_cid_one_pass_stream(lb_ctx->cid_encryption_context,
-        target.id + id_offset, lb_ctx->server_id_length, target.id + 1, lb_ctx->nonce_length);
-    /* First pass -- obtain server-id */
-    picoquic_lb_compat_cid_one_pass_stream(lb_ctx->cid_encryption_context, target.id + 1, lb_ctx->nonce_length,
-        target.id + id_offset, lb_ctx->server_id_length);
-
-    /* decode the server ID */
-    for (size_t i = 0; i < lb_ctx->server_id_length; i++) {
-        s_id64 <<= 8;
-        s_id64 += target.id[id_offset + i];
-    }
-
-    return s_id64;
-}
+    picoquic_load_balancer_cid_context_t* lb_ctx = (picoquic_load_balancer_cid_context_t*)cnx_id_cb_data;
+    size_t nb_decoded = 0;
+    const uint8_t* cid[PICOQUIC_LB_DECODE_BATCH];
+    uint8_t cid_length[PICOQUIC_LB_DECODE_BATCH];
 
-static uint64_t picoquic_lb_compat_cid_verify_block_cipher(picoquic_quic_t* quic,
-    picoquic_load_balancer_cid_context_t* lb_ctx, picoquic_connection_id_t const* cnx_id)
-{
-    uint8_t decoded[16];
-    uint64_t s_id64 = 0;
+    for (size_t i = 0; i < nb_cnx_id; i += PICOQUIC_LB_DECODE_BATCH) {
+        size_t nb = nb_cnx_id - i;
 
-    /* decrypt 16 bytes */
-    picoquic_aes128_ecb_encrypt(lb_ctx->cid_decryption_context, decoded, cnx_id->id + 1, 16);
-    /* Decode the server ID */
-    if (s_id64 == 0) {
-        for (size_t i = 0; i < lb_ctx->server_id_length; i++) {
-            s_id64 <<= 8;
-            s_id64 += decoded[i];
+        if (nb > PICOQUIC_LB_DECODE_BATCH) {
+            nb = PICOQUIC_LB_DECODE_BATCH;
         }
-    }
-
-    return s_id64;
-}
-
-uint64_t picoquic_lb_compat_cid_verify(picoquic_quic_t* quic, void* cnx_id_cb_data, picoquic_connection_id_t const* cnx_id)
-{
-    picoquic_load_balancer_cid_context_t* lb_ctx = (picoquic_load_balancer_cid_context_t*)cnx_id_cb_data;
-    uint64_t server_id64;
-
-    if (cnx_id->id_len != lb_ctx->connection_id_length) {
-        server_id64 = UINT64_MAX;
-    }
-    else {
-        switch (lb_ctx->method) {
-        case picoquic_load_balancer_cid_clear:
-            server_id64 = picoquic_lb_compat_cid_verify_clear(quic, lb_ctx, cnx_id);
-            break;
-        case picoquic_load_balancer_cid_stream_cipher:
-            server_id64 = picoquic_lb_compat_cid_verify_stream_cipher(quic, lb_ctx, cnx_id);
-            break;
-        case picoquic_load_balancer_cid_block_cipher:
-            server_id64 = picoquic_lb_compat_cid_verify_block_cipher(quic, lb_ctx, cnx_id);
-            break;
-        default:
-            /* Error, unknown method */
-            server_id64 = UINT64_MAX;
-            break;
+        for (size_t k = 0; k < nb; k++) {
+            cid[k] = cnx_id[i + k].id;
+            cid_length[k] = cnx_id[i + k].id_len;
         }
+        nb_decoded += picoquic_lb_decode_server_ids(&lb_ctx->decoder, cid, cid_length, nb, server_id64 + i);
     }
 
-    return server_id64;
+    return nb_decoded;
 }
 
 int picoquic_lb_compat_cid_config_parse(picoquic_load_balancer_config_t* lb_config, char const* txt, size_t txt_length)
@@ -477,6 +430,18 @@ int picoquic_lb_compat_cid_config(picoquic_quic_t* quic, picoquic_load_balancer_
                         }
                     }
                 }
+                if (ret == 0 && picoquic_lb_decoder_init(&lb_ctx->decoder, lb_ctx->method,
+                    lb_ctx->first_byte_encodes_length, lb_ctx->server_id_length, lb_ctx->nonce_length,
+                    lb_ctx->connection_id_length, picoquic_aes128_ecb_encrypt,
+                    lb_ctx->cid_encryption_context, lb_ctx->cid_decryption_context) != 0) {
+                    if (lb_ctx->cid_encryption_context != NULL) {
+                        picoquic_aes128_ecb_free(lb_ctx->cid_encryption_context);
+                    }
+                    if (lb_ctx->cid_decryption_context != NULL) {
+                        picoquic_aes128_ecb_free(lb_ctx->cid_decryption_context);
+                    }
+                    ret = -1;
+                }
                 if (ret != 0) {
                     /* if context allocation failed, free the copy */
                     free(lb_ctx);
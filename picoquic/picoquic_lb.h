@@ -23,6 +23,7 @@
 #define PICOQUIC_LB_H
 
 #include "picoquic.h"
+#include "picoquic_lb_decode.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -38,12 +39,6 @@ extern "C" {
  * The configuration options are encoded in the picoquic_load_balancer_config_t structure.
  */
 
-typedef enum {
-    picoquic_load_balancer_cid_clear,
-    picoquic_load_balancer_cid_stream_cipher,
-    picoquic_load_balancer_cid_block_cipher
-} picoquic_load_balancer_cid_method_enum;
-
 typedef struct st_picoquic_load_balancer_config_t {
     picoquic_load_balancer_cid_method_enum method;
     unsigned int rotation_bits : 2;
@@ -71,10 +66,14 @@ typedef struct st_picoquic_load_balancer_cid_context_t {
     uint8_t server_id[16];
     void* cid_encryption_context; /* used in stream and cipher mode */
     void* cid_decryption_context; /* used in block cipher mode */
+    picoquic_lb_decoder_t decoder;
 } picoquic_load_balancer_cid_context_t;
 
 void picoquic_lb_compat_cid_generate(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id_local, picoquic_connection_id_t cnx_id_remote, void* cnx_id_cb_data, picoquic_connection_id_t* cnx_id_returned);
 uint64_t picoquic_lb_compat_cid_verify(picoquic_quic_t* quic, void* cnx_id_cb_data, picoquic_connection_id_t const* cnx_id);
+/* Decode the server IDs of a batch of CIDs, see picoquic_lb_decode_server_ids */
+size_t picoquic_lb_compat_cid_verify_batch(void* cnx_id_cb_data, picoquic_connection_id_t const* cnx_id,
+    size_t nb_cnx_id, uint64_t* server_id64);
 #ifdef __cplusplus
 }
 #endif
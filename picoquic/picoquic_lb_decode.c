@@ -0,0 +1,184 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <string.h>
+#include "picoquic_lb_decode.h"
+
+int picoquic_lb_decoder_init(picoquic_lb_decoder_t* decoder, picoquic_load_balancer_cid_method_enum method,
+    int first_byte_encodes_length, uint8_t server_id_length, uint8_t nonce_length, uint8_t connection_id_length,
+    picoquic_lb_ecb_fn ecb_fn, void* ecb_encrypt_ctx, void* ecb_decrypt_ctx)
+{
+    int ret = 0;
+
+    memset(decoder, 0, sizeof(picoquic_lb_decoder_t));
+
+    if (connection_id_length > PICOQUIC_LB_CID_MAX_SIZE) {
+        ret = -1;
+    }
+    else {
+        switch (method) {
+        case picoquic_load_balancer_cid_clear:
+            if (server_id_length + 1 > connection_id_length) {
+                ret = -1;
+            }
+            break;
+        case picoquic_load_balancer_cid_stream_cipher:
+            if (nonce_length < 8 || nonce_length > 16 ||
+                nonce_length + server_id_length + 1 > connection_id_length ||
+                ecb_fn == NULL || ecb_encrypt_ctx == NULL) {
+                ret = -1;
+            }
+            break;
+        case picoquic_load_balancer_cid_block_cipher:
+            if (connection_id_length < 17 || server_id_length > 15 ||
+                ecb_fn == NULL || ecb_decrypt_ctx == NULL) {
+                ret = -1;
+            }
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        decoder->method = method;
+        decoder->first_byte_encodes_length = (first_byte_encodes_length) ? 1 : 0;
+        decoder->server_id_length = server_id_length;
+        decoder->nonce_length = nonce_length;
+        decoder->connection_id_length = connection_id_length;
+        decoder->ecb_fn = ecb_fn;
+        decoder->ecb_encrypt_ctx = ecb_encrypt_ctx;
+        decoder->ecb_decrypt_ctx = ecb_decrypt_ctx;
+    }
+
+    return ret;
+}
+
+static uint64_t picoquic_lb_decode_bytes(const uint8_t* bytes, size_t length)
+{
+    uint64_t s_id64 = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        s_id64 <<= 8;
+        s_id64 += bytes[i];
+    }
+
+    return s_id64;
+}
+
+/* One pass of the stream cipher, applied to all the CIDs in the group:
+ * the masks are obtained by encrypting the zero padded source field of
+ * each CID, in a single ECB call, and then applied to the target fields.
+ */
+static void picoquic_lb_decode_stream_pass(const picoquic_lb_decoder_t* decoder,
+    uint8_t work[][PICOQUIC_LB_CID_MAX_SIZE], size_t nb, uint8_t* masks,
+    size_t source_offset, size_t source_length, size_t target_offset, size_t target_length)
+{
+    memset(masks, 0, nb * 16);
+    for (size_t k = 0; k < nb; k++) {
+        memcpy(masks + 16 * k, work[k] + source_offset, source_length);
+    }
+    decoder->ecb_fn(decoder->ecb_encrypt_ctx, masks, masks, nb * 16);
+    for (size_t k = 0; k < nb; k++) {
+        for (size_t i = 0; i < target_length; i++) {
+            work[k][target_offset + i] ^= masks[16 * k + i];
+        }
+    }
+}
+
+size_t picoquic_lb_decode_server_ids(const picoquic_lb_decoder_t* decoder, const uint8_t* const* cid,
+    const uint8_t* cid_length, size_t nb_cids, uint64_t* server_id)
+{
+    size_t nb_decoded = 0;
+    size_t i = 0;
+    uint8_t blocks[PICOQUIC_LB_DECODE_BATCH * 16];
+    uint8_t work[PICOQUIC_LB_DECODE_BATCH][PICOQUIC_LB_CID_MAX_SIZE];
+    size_t index[PICOQUIC_LB_DECODE_BATCH];
+
+    while (i < nb_cids) {
+        size_t nb = 0;
+        size_t id_offset = ((size_t)1) + decoder->nonce_length;
+
+        /* Gather a group of CIDs of the expected length */
+        while (i < nb_cids && nb < PICOQUIC_LB_DECODE_BATCH) {
+            size_t length = (cid_length != NULL) ? cid_length[i] :
+                ((decoder->first_byte_encodes_length) ? (size_t)(cid[i][0] & 0x3F) + 1 : decoder->connection_id_length);
+
+            if (length != decoder->connection_id_length) {
+                server_id[i] = UINT64_MAX;
+            }
+            else {
+                index[nb++] = i;
+            }
+            i++;
+        }
+        if (nb == 0) {
+            continue;
+        }
+
+        switch (decoder->method) {
+        case picoquic_load_balancer_cid_clear:
+            for (size_t k = 0; k < nb; k++) {
+                server_id[index[k]] = picoquic_lb_decode_bytes(cid[index[k]] + 1, decoder->server_id_length);
+            }
+            break;
+        case picoquic_load_balancer_cid_stream_cipher:
+            for (size_t k = 0; k < nb; k++) {
+                memcpy(work[k], cid[index[k]], decoder->connection_id_length);
+            }
+            /* First pass -- obtain intermediate server ID */
+            picoquic_lb_decode_stream_pass(decoder, work, nb, blocks, 1, decoder->nonce_length,
+                id_offset, decoder->server_id_length);
+            /* Second pass -- obtain nonce */
+            picoquic_lb_decode_stream_pass(decoder, work, nb, blocks, id_offset, decoder->server_id_length,
+                1, decoder->nonce_length);
+            /* Third pass -- obtain server-id */
+            picoquic_lb_decode_stream_pass(decoder, work, nb, blocks, 1, decoder->nonce_length,
+                id_offset, decoder->server_id_length);
+            for (size_t k = 0; k < nb; k++) {
+                server_id[index[k]] = picoquic_lb_decode_bytes(work[k] + id_offset, decoder->server_id_length);
+            }
+            break;
+        case picoquic_load_balancer_cid_block_cipher:
+            /* decrypt 16 bytes of each CID in a single call */
+            for (size_t k = 0; k < nb; k++) {
+                memcpy(blocks + 16 * k, cid[index[k]] + 1, 16);
+            }
+            decoder->ecb_fn(decoder->ecb_decrypt_ctx, blocks, blocks, nb * 16);
+            for (size_t k = 0; k < nb; k++) {
+                server_id[index[k]] = picoquic_lb_decode_bytes(blocks + 16 * k, decoder->server_id_length);
+            }
+            break;
+        default:
+            /* Error, unknown method */
+            for (size_t k = 0; k < nb; k++) {
+                server_id[index[k]] = UINT64_MAX;
+            }
+            nb = 0;
+            break;
+        }
+        nb_decoded += nb;
+    }
+
+    return nb_decoded;
+}
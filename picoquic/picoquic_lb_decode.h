@@ -0,0 +1,95 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Batch decoding of QUIC-LB connection IDs.
+*
+* A load balancer only needs to retrieve the server ID from the connection
+* ID of each incoming packet. This module does just that, without creating
+* a QUIC context, and without any dependency other than the C library. The
+* AES-ECB primitive is provided by the caller as a function pointer, with the
+* same signature as picoquic_aes128_ecb_encrypt. The decryption context is
+* only used by the block cipher method, the encryption context only by the
+* stream cipher method.
+*
+* The CIDs are processed in groups of up to PICOQUIC_LB_DECODE_BATCH. For each
+* group, the decoder gathers the encrypted blocks in a contiguous buffer and
+* calls the ECB function once per pass: one call for the block cipher method,
+* three calls for the stream cipher method. This lets the AES implementation
+* pipeline the blocks, instead of paying a call and a key schedule lookup for
+* each CID.
+*
+* The encoding is the one used by picoquic_lb_compat_cid_generate, and
+* picoquic_lb_compat_cid_verify is implemented on top of this module.
+*/
+
+#ifndef PICOQUIC_LB_DECODE_H
+#define PICOQUIC_LB_DECODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICOQUIC_LB_DECODE_BATCH 32
+#define PICOQUIC_LB_CID_MAX_SIZE 20
+
+typedef enum {
+    picoquic_load_balancer_cid_clear,
+    picoquic_load_balancer_cid_stream_cipher,
+    picoquic_load_balancer_cid_block_cipher
+} picoquic_load_balancer_cid_method_enum;
+
+typedef void (*picoquic_lb_ecb_fn)(void* ecb_ctx, uint8_t* output, const uint8_t* input, size_t len);
+
+typedef struct st_picoquic_lb_decoder_t {
+    picoquic_load_balancer_cid_method_enum method;
+    unsigned int first_byte_encodes_length : 1;
+    uint8_t server_id_length;
+    uint8_t nonce_length; /* used in stream cipher mode */
+    uint8_t connection_id_length;
+    picoquic_lb_ecb_fn ecb_fn;
+    void* ecb_encrypt_ctx; /* used in stream cipher mode */
+    void* ecb_decrypt_ctx; /* used in block cipher mode */
+} picoquic_lb_decoder_t;
+
+/* Initialize a decoder. Returns -1 if the parameters are not valid, or if
+ * the ECB function or contexts required by the method are missing. */
+int picoquic_lb_decoder_init(picoquic_lb_decoder_t* decoder, picoquic_load_balancer_cid_method_enum method,
+    int first_byte_encodes_length, uint8_t server_id_length, uint8_t nonce_length, uint8_t connection_id_length,
+    picoquic_lb_ecb_fn ecb_fn, void* ecb_encrypt_ctx, void* ecb_decrypt_ctx);
+
+/* Decode the server IDs of nb_cids connection IDs. Each cid[i] points to the
+ * first byte of a CID. If cid_length is NULL, the length is read from the
+ * first byte when the configuration encodes it, and otherwise assumed to be
+ * the configured length. Server IDs are set to UINT64_MAX for CIDs that do not
+ * have the configured length. Returns the number of server IDs decoded. */
+size_t picoquic_lb_decode_server_ids(const picoquic_lb_decoder_t* decoder, const uint8_t* const* cid,
+    const uint8_t* cid_length, size_t nb_cids, uint64_t* server_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_LB_DECODE_H */
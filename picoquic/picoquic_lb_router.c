@@ -0,0 +1,332 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_lb_router.h"
+
+#define PICOQUIC_LB_ROUTER_VERSION_1 0x00000001u
+#define PICOQUIC_LB_ROUTER_VERSION_2 0x6b3343cfu
+#define PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH 8
+
+static uint64_t picoquic_lb_router_mix(uint64_t x)
+{
+    /* Finalizer of splitmix64 */
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t picoquic_lb_router_hash_cid(const picoquic_lb_router_t* router, const uint8_t* cid, size_t cid_length)
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ router->hash_seed;
+
+    for (size_t i = 0; i < cid_length; i++) {
+        h ^= cid[i];
+        h *= 0x100000001b3ull;
+    }
+
+    return picoquic_lb_router_mix(h);
+}
+
+int picoquic_lb_router_init(picoquic_lb_router_t* router, const picoquic_lb_decoder_t* decoder,
+    size_t nb_backends_max, uint64_t hash_seed)
+{
+    int ret = 0;
+
+    memset(router, 0, sizeof(picoquic_lb_router_t));
+    if (nb_backends_max == 0 || nb_backends_max > UINT16_MAX) {
+        ret = -1;
+    }
+    else {
+        router->decoder = *decoder;
+        router->nb_backends_max = nb_backends_max;
+        router->hash_seed = hash_seed;
+        router->probe_interval = PICOQUIC_LB_ROUTER_PROBE_INTERVAL;
+        router->health_timeout = PICOQUIC_LB_ROUTER_HEALTH_TIMEOUT;
+        router->backends = (picoquic_lb_backend_t*)malloc(nb_backends_max * sizeof(picoquic_lb_backend_t));
+        router->by_server_id = (uint16_t*)malloc(nb_backends_max * sizeof(uint16_t));
+        if (router->backends == NULL || router->by_server_id == NULL) {
+            picoquic_lb_router_clear(router);
+            ret = -1;
+        }
+        else {
+            memset(router->backends, 0, nb_backends_max * sizeof(picoquic_lb_backend_t));
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_lb_router_clear(picoquic_lb_router_t* router)
+{
+    if (router->backends != NULL) {
+        free(router->backends);
+    }
+    if (router->by_server_id != NULL) {
+        free(router->by_server_id);
+    }
+    memset(router, 0, sizeof(picoquic_lb_router_t));
+}
+
+/* Binary search in the sorted index. Returns the position of the first
+ * entry with a server ID larger than or equal to the searched value. */
+static size_t picoquic_lb_router_search(const picoquic_lb_router_t* router, uint64_t server_id)
+{
+    size_t low = 0;
+    size_t high = router->nb_backends;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (router->backends[router->by_server_id[middle]].server_id < server_id) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+static int picoquic_lb_router_find_server_id(const picoquic_lb_router_t* router, uint64_t server_id)
+{
+    int backend_index = -1;
+    size_t position = picoquic_lb_router_search(router, server_id);
+
+    if (position < router->nb_backends && router->backends[router->by_server_id[position]].server_id == server_id) {
+        backend_index = router->by_server_id[position];
+    }
+
+    return backend_index;
+}
+
+int picoquic_lb_router_add_backend(picoquic_lb_router_t* router, uint64_t server_id, uint64_t current_time)
+{
+    int backend_index = -1;
+
+    if (router->nb_backends < router->nb_backends_max && server_id != UINT64_MAX &&
+        picoquic_lb_router_find_server_id(router, server_id) < 0) {
+        size_t position = picoquic_lb_router_search(router, server_id);
+        picoquic_lb_backend_t* backend = &router->backends[router->nb_backends];
+
+        memset(backend, 0, sizeof(picoquic_lb_backend_t));
+        backend->server_id = server_id;
+        backend->next_probe_time = current_time;
+        backend->last_response_time = current_time;
+        backend->is_healthy = 1;
+        backend_index = (int)router->nb_backends;
+
+        memmove(router->by_server_id + position + 1, router->by_server_id + position,
+            (router->nb_backends - position) * sizeof(uint16_t));
+        router->by_server_id[position] = (uint16_t)backend_index;
+        router->nb_backends++;
+    }
+
+    return backend_index;
+}
+
+/* Rendezvous hashing: pick the backend with the highest score. If no backend
+ * is healthy, pick among all of them rather than drop the packet. */
+static int picoquic_lb_router_hash_route(const picoquic_lb_router_t* router, const uint8_t* cid, size_t cid_length)
+{
+    int backend_index = -1;
+    uint64_t best_score = 0;
+    uint64_t cid_hash = picoquic_lb_router_hash_cid(router, cid, cid_length);
+
+    for (int pass = 0; pass < 2 && backend_index < 0; pass++) {
+        for (size_t i = 0; i < router->nb_backends; i++) {
+            if (pass == 1 || router->backends[i].is_healthy) {
+                uint64_t score = picoquic_lb_router_mix(cid_hash ^ picoquic_lb_router_mix(router->backends[i].server_id));
+                if (backend_index < 0 || score > best_score) {
+                    backend_index = (int)i;
+                    best_score = score;
+                }
+            }
+        }
+    }
+
+    return backend_index;
+}
+
+/* Locate the destination CID in the packet header. Returns 0 if the header
+ * is too short to contain one. For short header packets, the CID length is
+ * not in the header, and the configured length is assumed. */
+static int picoquic_lb_router_parse_dcid(const picoquic_lb_router_t* router, const uint8_t* packet, size_t length,
+    const uint8_t** dcid, size_t* dcid_length, int* is_long_header)
+{
+    int is_parsed = 0;
+
+    if (length > 0) {
+        *is_long_header = (packet[0] & 0x80) != 0;
+        if (*is_long_header) {
+            if (length >= 6 && packet[5] <= PICOQUIC_LB_CID_MAX_SIZE && length >= (size_t)6 + packet[5]) {
+                *dcid = packet + 6;
+                *dcid_length = packet[5];
+                is_parsed = 1;
+            }
+        }
+        else if (length >= (size_t)1 + router->decoder.connection_id_length) {
+            *dcid = packet + 1;
+            *dcid_length = (router->decoder.first_byte_encodes_length) ?
+                (size_t)(packet[1] & 0x3F) + 1 : router->decoder.connection_id_length;
+            is_parsed = 1;
+        }
+    }
+
+    return is_parsed;
+}
+
+void picoquic_lb_router_route_batch(picoquic_lb_router_t* router, const uint8_t* const* packet,
+    const size_t* length, size_t nb_packets, int* backend_index)
+{
+    const uint8_t* dcid[PICOQUIC_LB_DECODE_BATCH];
+    size_t dcid_length[PICOQUIC_LB_DECODE_BATCH];
+    uint8_t decode_length[PICOQUIC_LB_DECODE_BATCH];
+    uint64_t server_id[PICOQUIC_LB_DECODE_BATCH];
+    int is_long_header[PICOQUIC_LB_DECODE_BATCH];
+
+    for (size_t i = 0; i < nb_packets; i += PICOQUIC_LB_DECODE_BATCH) {
+        size_t nb = nb_packets - i;
+
+        if (nb > PICOQUIC_LB_DECODE_BATCH) {
+            nb = PICOQUIC_LB_DECODE_BATCH;
+        }
+        /* Parse the headers, then decode all the server IDs at once */
+        for (size_t k = 0; k < nb; k++) {
+            if (!picoquic_lb_router_parse_dcid(router, packet[i + k], length[i + k], &dcid[k], &dcid_length[k], &is_long_header[k])) {
+                dcid[k] = packet[i + k];
+                dcid_length[k] = 0;
+                is_long_header[k] = 0;
+            }
+            /* Lengths that do not match the configuration are rejected by the decoder */
+            decode_length[k] = (dcid_length[k] == router->decoder.connection_id_length) ? (uint8_t)dcid_length[k] : 0;
+        }
+        (void)picoquic_lb_decode_server_ids(&router->decoder, dcid, decode_length, nb, server_id);
+
+        for (size_t k = 0; k < nb; k++) {
+            int x = (server_id[k] == UINT64_MAX) ? -1 : picoquic_lb_router_find_server_id(router, server_id[k]);
+
+            if (x >= 0) {
+                router->nb_routed_by_id++;
+            }
+            else if (is_long_header[k]) {
+                x = picoquic_lb_router_hash_route(router, dcid[k], dcid_length[k]);
+                if (x >= 0) {
+                    router->nb_routed_by_hash++;
+                }
+            }
+            if (x >= 0) {
+                router->backends[x].nb_packets_routed++;
+            }
+            else {
+                router->nb_dropped++;
+            }
+            backend_index[i + k] = x;
+        }
+    }
+}
+
+int picoquic_lb_router_route(picoquic_lb_router_t* router, const uint8_t* packet, size_t length)
+{
+    int backend_index = -1;
+
+    picoquic_lb_router_route_batch(router, &packet, &length, 1, &backend_index);
+
+    return backend_index;
+}
+
+/* The probe CIDs encode the backend index and a tag derived from the hash
+ * seed, so that responses can be authenticated, loosely, and attributed. */
+static void picoquic_lb_router_probe_cid(const picoquic_lb_router_t* router, int backend_index, uint8_t* cid)
+{
+    uint64_t tag = picoquic_lb_router_mix(router->hash_seed ^ (uint64_t)backend_index);
+
+    cid[0] = (uint8_t)(backend_index >> 8);
+    cid[1] = (uint8_t)backend_index;
+    for (int i = 2; i < PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH; i++) {
+        cid[i] = (uint8_t)tag;
+        tag >>= 8;
+    }
+}
+
+size_t picoquic_lb_router_format_probe(picoquic_lb_router_t* router, int backend_index,
+    uint8_t* buffer, size_t buffer_size, uint64_t current_time)
+{
+    size_t length = 0;
+
+    if (backend_index >= 0 && (size_t)backend_index < router->nb_backends &&
+        buffer_size >= PICOQUIC_LB_ROUTER_PROBE_SIZE) {
+        uint32_t version = PICOQUIC_LB_ROUTER_PROBE_VERSION;
+
+        memset(buffer, 0, PICOQUIC_LB_ROUTER_PROBE_SIZE);
+        buffer[0] = 0xc0;
+        for (int i = 0; i < 4; i++) {
+            buffer[1 + i] = (uint8_t)(version >> (24 - 8 * i));
+        }
+        buffer[5] = PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH;
+        picoquic_lb_router_probe_cid(router, backend_index, buffer + 6);
+        buffer[6 + PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH] = PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH;
+        picoquic_lb_router_probe_cid(router, backend_index, buffer + 7 + PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH);
+        length = PICOQUIC_LB_ROUTER_PROBE_SIZE;
+        router->backends[backend_index].next_probe_time = current_time + router->probe_interval;
+    }
+
+    return length;
+}
+
+int picoquic_lb_router_process_probe_response(picoquic_lb_router_t* router, const uint8_t* packet,
+    size_t length, uint64_t current_time)
+{
+    int backend_index = -1;
+
+    /* Version negotiation: long header, version 0, DCID is the probe SCID */
+    if (length >= 6 + PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH && (packet[0] & 0x80) != 0 &&
+        packet[1] == 0 && packet[2] == 0 && packet[3] == 0 && packet[4] == 0 &&
+        packet[5] == PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH) {
+        uint8_t expected[PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH];
+        int x = (packet[6] << 8) | packet[7];
+
+        if ((size_t)x < router->nb_backends) {
+            picoquic_lb_router_probe_cid(router, x, expected);
+            if (memcmp(expected, packet + 6, PICOQUIC_LB_ROUTER_PROBE_CID_LENGTH) == 0) {
+                router->backends[x].last_response_time = current_time;
+                router->backends[x].is_healthy = 1;
+                backend_index = x;
+            }
+        }
+    }
+
+    return backend_index;
+}
+
+void picoquic_lb_router_update_health(picoquic_lb_router_t* router, uint64_t current_time)
+{
+    for (size_t i = 0; i < router->nb_backends; i++) {
+        if (router->backends[i].last_response_time + router->health_timeout < current_time) {
+            router->backends[i].is_healthy = 0;
+        }
+    }
+}
@@ -0,0 +1,107 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Stateless routing of QUIC packets to servers, based on QUIC-LB CIDs.
+*
+* The router holds a table of backends, identified by the server ID that
+* they encode in their connection IDs. Packets are routed as follows:
+*
+* - The destination CID is extracted from the packet header. If it has the
+*   configured length, its server ID is decoded, and if that matches a
+*   backend the packet goes to that backend, whether it is healthy or not:
+*   the connection state is there, and nowhere else.
+* - Otherwise, long header packets, typically client Initial and 0-RTT
+*   packets, are routed by rendezvous hashing of the DCID over the healthy
+*   backends. All the packets sent by a client with the same DCID reach the
+*   same backend, and only the flows of a failing backend are moved.
+* - Short header packets that do not match a backend are dropped.
+*
+* Backend health is checked with Version Negotiation. The router sends to
+* each backend a long header packet with a reserved version number, padded
+* to 1200 bytes, and any QUIC server replies with a Version Negotiation
+* packet echoing the probe CIDs. A backend that does not reply within the
+* health timeout is considered down, and receives no new connections.
+*
+* The routing uses the batch CID decoder, so that the server IDs of a
+* whole batch of packets are decoded with a few AES calls.
+*/
+
+#ifndef PICOQUIC_LB_ROUTER_H
+#define PICOQUIC_LB_ROUTER_H
+
+#include "picoquic_lb_decode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICOQUIC_LB_ROUTER_PROBE_INTERVAL 1000000ull
+#define PICOQUIC_LB_ROUTER_HEALTH_TIMEOUT 3500000ull
+#define PICOQUIC_LB_ROUTER_PROBE_SIZE 1200
+#define PICOQUIC_LB_ROUTER_PROBE_VERSION 0x0a1a2a3au
+
+typedef struct st_picoquic_lb_backend_t {
+    uint64_t server_id;
+    uint64_t next_probe_time;
+    uint64_t last_response_time;
+    uint64_t nb_packets_routed;
+    unsigned int is_healthy : 1;
+} picoquic_lb_backend_t;
+
+typedef struct st_picoquic_lb_router_t {
+    picoquic_lb_decoder_t decoder;
+    picoquic_lb_backend_t* backends;
+    size_t nb_backends;
+    size_t nb_backends_max;
+    uint16_t* by_server_id; /* Backend indices, sorted by server ID */
+    uint64_t hash_seed;
+    uint64_t probe_interval;
+    uint64_t health_timeout;
+    uint64_t nb_routed_by_id;
+    uint64_t nb_routed_by_hash;
+    uint64_t nb_dropped;
+} picoquic_lb_router_t;
+
+int picoquic_lb_router_init(picoquic_lb_router_t* router, const picoquic_lb_decoder_t* decoder,
+    size_t nb_backends_max, uint64_t hash_seed);
+void picoquic_lb_router_clear(picoquic_lb_router_t* router);
+/* Returns the index of the new backend, or -1 if the table is full or the
+ * server ID is already used. Backends are healthy until the first timeout. */
+int picoquic_lb_router_add_backend(picoquic_lb_router_t* router, uint64_t server_id, uint64_t current_time);
+/* Returns the index of the backend for the packet, or -1 if it shall be dropped. */
+int picoquic_lb_router_route(picoquic_lb_router_t* router, const uint8_t* packet, size_t length);
+void picoquic_lb_router_route_batch(picoquic_lb_router_t* router, const uint8_t* const* packet,
+    const size_t* length, size_t nb_packets, int* backend_index);
+/* Health checks. Probes are due when current_time reaches next_probe_time.
+ * The responses are matched by their CIDs, returning the backend index or -1. */
+size_t picoquic_lb_router_format_probe(picoquic_lb_router_t* router, int backend_index,
+    uint8_t* buffer, size_t buffer_size, uint64_t current_time);
+int picoquic_lb_router_process_probe_response(picoquic_lb_router_t* router, const uint8_t* packet,
+    size_t length, uint64_t current_time);
+void picoquic_lb_router_update_health(picoquic_lb_router_t* router, uint64_t current_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_LB_ROUTER_H */
@@ -34,6 +34,10 @@ extern "C" {
 #define PICOQUIC_PACKET_LOOP_RECV_MAX 10
 #define PICOQUIC_PACKET_LOOP_SEND_MAX 10
 #define PICOQUIC_PACKET_LOOP_SEND_DELAY_MAX 2500
+#define PICOQUIC_PACKET_LOOP_BATCH_MAX 64
+#define PICOQUIC_PACKET_LOOP_TXTIME_SEND_MAX 64
+#define PICOQUIC_PACKET_LOOP_ZEROCOPY_MIN 16384
+#define PICOQUIC_PACKET_LOOP_BUSY_POLL_USEC 50
 
 typedef struct st_picoquic_socket_ctx_t {
     SOCKET_TYPE fd;
@@ -45,6 +49,17 @@ typedef struct st_picoquic_socket_ctx_t {
     unsigned int is_started : 1;
     unsigned int supports_udp_send_coalesced : 1;
     unsigned int supports_udp_recv_coalesced : 1;
+    unsigned int reuse_port : 1; /* Set SO_REUSEPORT before binding to a non zero port */
+    /* If > 0, attach a program steering packets to the socket of rank DCID[1] % nb_shards in the SO_REUSEPORT group */
+    int reuseport_steering_shards;
+    unsigned int use_txtime : 1; /* Set SO_TXTIME, cleared if the socket does not support it */
+    unsigned int use_zerocopy : 1; /* Set SO_ZEROCOPY, cleared if the socket does not support it */
+    uint32_t zerocopy_next_id; /* Sequence number of the next MSG_ZEROCOPY send on this socket */
+    unsigned int use_rio : 1; /* Windows only: open with WSA_FLAG_REGISTERED_IO, do not post an overlapped receive */
+    unsigned int use_rx_timestamps : 1; /* Request kernel receive timestamps, cleared if the socket does not support them */
+    unsigned int use_gro : 1; /* Linux only: set UDP_GRO, the reads may then return up to 64KB of coalesced datagrams */
+    uint64_t receive_time; /* Kernel timestamp of the last datagram received, or 0 */
+    int busy_poll_usec; /* Set SO_BUSY_POLL to that value if not zero, cleared if the socket does not support it */
     /* Receive data buffer and fields */
     size_t recv_buffer_size;
     uint8_t* recv_buffer;
@@ -81,7 +96,8 @@ typedef enum {
     picoquic_packet_loop_time_check, /* argument type packet_loop_time_check_arg_t*. Optional. */
     picoquic_packet_loop_system_call_duration, /* argument type packet_loop_system_call_duration_t*. Optional. */
     picoquic_packet_loop_wake_up, /* no argument (void* NULL). Used when loop wakeup is supported */
-    picoquic_packet_loop_alt_port /* Provide alt port for testing multipath or migration */
+    picoquic_packet_loop_alt_port, /* Provide alt port for testing multipath or migration */
+    picoquic_packet_loop_latency_report /* argument type picoquic_loop_latency_t*. Optional. */
 } picoquic_packet_loop_cb_enum;
 
 /* System call statistics.
@@ -100,6 +116,17 @@ typedef struct st_packet_loop_system_call_duration_t {
     uint64_t scd_dev;
 } packet_loop_system_call_duration_t;
 
+/* Latency report.
+* If the application selects the "latency report" option, the loop
+* measures its own latencies, see picoquic_loop_latency_t in picoquic.h,
+* and passes the histograms to the application about once per
+* PICOQUIC_PACKET_LOOP_LATENCY_REPORT_INTERVAL, and once more when the
+* loop terminates. The histograms are cumulative since the start of the
+* loop. The loop also measures its latencies when the context metrics
+* are enabled, and then adds them to the metrics snapshot.
+*/
+#define PICOQUIC_PACKET_LOOP_LATENCY_REPORT_INTERVAL 1000000ull
+
 /* The time check option passes as argument a pointer to a structure specifying
 * the current time and the proposed delta. The application uses the specified
 * current time to compute an updated delta.
@@ -119,11 +146,234 @@ typedef struct st_picoquic_packet_loop_options_t {
     unsigned int do_time_check : 1; /* App should be polled for next time before sock select */
     unsigned int do_system_call_duration : 1; /* App should be notified if the system call duration varies */
     unsigned int provide_alt_port : 1; /* Used for simulating multipath or migrations. */
+    unsigned int do_latency_report : 1; /* App should be passed the loop latency histograms */
 } picoquic_packet_loop_options_t;
 
+/* Packet I/O providers.
+*
+* By default, the packet loop sends and receives packets through UDP sockets.
+* A provider replaces the sockets by another packet I/O framework, such as
+* AF_XDP or DPDK. Each packet is described by a picoquic_packet_io_t, in
+* which `bytes` points to the UDP payload, inside a buffer owned by the
+* provider. The provider may use the `handle` field to find the buffer
+* when it is released.
+*
+* The provider functions are:
+*
+* - open: create the provider context, using the loop parameters and the
+*   provider specific io_provider_param. If wake_up_fd is not -1, the wait
+*   function shall return when that file descriptor is readable. If the
+*   provider can, it sets local_addr to an address at which the local
+*   port can be reached, which the loop passes in the port update callback.
+* - close: release the resources of the context.
+* - rx_burst: get up to nb_max received packets, without waiting. Returns
+*   the number of packets, or -1 if an error occurred. The packets are
+*   returned to the provider by calling release_buffer.
+* - tx_burst: send the nb_packets packets, which were prepared in buffers
+*   obtained with get_buffer. The provider takes back all the buffers,
+*   whether they are sent or not. Returns the number of packets sent; if
+*   that is less than nb_packets, sock_err is set to the error that stopped
+*   the burst.
+* - get_buffer: set bytes and buffer_size to a free send buffer. Returns
+*   a non zero value if no buffer is available.
+* - release_buffer: return a buffer to the provider.
+* - wait: wait for packets to arrive, for at most delta_t microseconds.
+*   Returns 1 if packets may be available, 0 otherwise, or -1 on error.
+*   Sets is_wake_up if wake_up_fd became readable. The loop reads the
+*   wake up signal.
+* - wake: optional. If set, picoquic_wake_up_network_thread calls it
+*   instead of writing on the wake up pipe, and the provider shall ensure
+*   that the current or next call to wait returns promptly. This is meant
+*   for providers that poll the hardware instead of waiting on a file
+*   descriptor. The function is called from application threads.
+*
+* If supports_segmentation is set, a send buffer may contain several
+* packets of send_msg_size bytes, the last one possibly shorter, as
+* with UDP GSO. Otherwise each buffer holds a single packet.
+*
+* picoquic_socket_io_provider implements the interface with UDP sockets,
+* see sockloop_provider.c. On Linux builds with PICOQUIC_WITH_AF_XDP,
+* picoquic_xdp_io_provider implements it with AF_XDP, see sockloop_xdp.c.
+*/
+typedef struct st_picoquic_packet_io_t {
+    uint8_t* bytes;
+    size_t length;
+    size_t buffer_size;
+    size_t send_msg_size;
+    struct sockaddr_storage addr_peer;
+    struct sockaddr_storage addr_local;
+    int if_index;
+    unsigned char ecn;
+    uint64_t receive_time; /* Hardware or kernel timestamp, or 0 */
+    uint64_t handle; /* Provider specific */
+} picoquic_packet_io_t;
+
+struct st_picoquic_packet_loop_param_t;
+
+typedef struct st_picoquic_packet_io_provider_t {
+    char const* name;
+    int (*open)(struct st_picoquic_packet_loop_param_t* param, void* provider_param, int wake_up_fd,
+        void** io_ctx, struct sockaddr_storage* local_addr);
+    void (*close)(void* io_ctx);
+    int (*rx_burst)(void* io_ctx, picoquic_packet_io_t* packets, int nb_max);
+    int (*tx_burst)(void* io_ctx, picoquic_packet_io_t* packets, int nb_packets, int* sock_err);
+    int (*get_buffer)(void* io_ctx, picoquic_packet_io_t* packet);
+    void (*release_buffer)(void* io_ctx, picoquic_packet_io_t* packet);
+    int (*wait)(void* io_ctx, int64_t delta_t, int* is_wake_up);
+    void (*wake)(void* io_ctx);
+    unsigned int supports_segmentation;
+} picoquic_packet_io_provider_t;
+
+extern const picoquic_packet_io_provider_t picoquic_socket_io_provider;
+
+/* Parameters of the AF_XDP provider, passed as io_provider_param.
+*
+* The provider binds an AF_XDP socket to the queue queue_id of the
+* interface if_index, and registers a UMEM of nb_frames frames. The
+* application must attach an XDP program to the interface that redirects
+* the UDP packets for the local port to that socket, using an XSKMAP entry
+* that it sets to the socket file descriptor. The provider stores that
+* descriptor in xsk_fd before the loop callback picoquic_packet_loop_ready.
+*
+* Outgoing packets are built with the source addresses local_addr_v4 or
+* local_addr_v6, with the port set to param->local_port, the source MAC
+* address local_mac, and the destination MAC address next_hop_mac. If
+* next_hop_mac is all zeroes, the provider uses the source MAC address of
+* the last packet received. This suits hosts that reach all peers through
+* the same router; the provider does not resolve neighbors.
+*
+* If zero_copy is set, the socket is bound with XDP_ZEROCOPY, which fails
+* if the driver does not support it. Otherwise the kernel selects the mode.
+*/
+typedef struct st_picoquic_xdp_param_t {
+    int if_index;
+    uint32_t queue_id;
+    uint32_t nb_frames;
+    int zero_copy;
+    uint8_t local_mac[6];
+    uint8_t next_hop_mac[6];
+    struct sockaddr_in local_addr_v4;
+    struct sockaddr_in6 local_addr_v6;
+    int xsk_fd; /* Set by the provider when the socket is open */
+} picoquic_xdp_param_t;
+
+#if defined(__linux__) && defined(PICOQUIC_WITH_AF_XDP)
+extern const picoquic_packet_io_provider_t picoquic_xdp_io_provider;
+#endif
+
 /* Version 2 of packet loop, works in progress.
 * Parameters are set in a struct, for future
 * extensibility.
+*
+* The parameter batch_depth sets the number of datagrams that the loop
+* will try to receive or send in a single system call. On Linux, values
+* larger than 1 cause the loop to use recvmmsg and sendmmsg, with a ring
+* of preallocated message headers and control buffers. On macOS and iOS,
+* the loop uses recvmsg_x and sendmsg_x if the system provides them, and
+* otherwise falls back to one system call per datagram; define
+* PICOQUIC_NO_MSG_X to disable that path. The value is capped
+* at PICOQUIC_PACKET_LOOP_BATCH_MAX. It is ignored on other platforms.
+*
+* If use_io_uring is set, the loop runs picoquic_packet_loop_uring instead
+* of picoquic_packet_loop_v3. That variant keeps multishot receive requests
+* posted on every socket and queues outgoing packets as sendmsg requests,
+* so that a single io_uring_enter call both submits the I/O and waits for
+* completions. It is only available on Linux builds with io_uring support.
+* If io_uring cannot be initialized, the regular loop is used instead.
+*
+* If use_rio is set, the loop runs picoquic_packet_loop_rio instead of
+* picoquic_packet_loop_v3 (Windows only). That variant uses Registered I/O:
+* the packet buffers are registered once, incoming packets are placed in
+* receive requests kept posted on every socket, and completions are
+* retrieved in batches. The outgoing packets prepared in a loop iteration
+* are committed with a single call per socket. Like the regular loop, it
+* uses UDP send and receive offload (USO and URO) when Windows supports
+* them, unless do_not_use_gso is set. If RIO cannot be
+* initialized, the regular loop is used instead.
+*
+* On Linux and BSD systems, the loop waits for incoming packets using
+* epoll or kqueue. The sockets are registered once, with edge triggered
+* notifications, and each socket is read until it is drained. Setting
+* use_select forces the loop to use select() instead.
+*
+* If reuse_port is set, the sockets bound to local_port are opened with
+* SO_REUSEPORT, so that several loops can share the same port. On Linux,
+* setting reuseport_steering_shards to the number of loops in the group
+* attaches a classic BPF program to the sockets, steering packets to the
+* socket of rank DCID[1] modulo that number. See picoquic_start_sharded_server.
+*
+* If txtime_horizon is not zero, the loop sets SO_TXTIME on the sockets
+* (Linux only). When no packet can be sent immediately but the next send is
+* due within txtime_horizon microseconds, for example because of pacing, the
+* loop prepares that packet immediately and attaches an SCM_TXTIME departure
+* time to it. The kernel holds the packet until that time, which requires
+* an egress qdisc supporting earliest departure time, such as fq. Up to
+* PICOQUIC_PACKET_LOOP_TXTIME_SEND_MAX packets are handed to the kernel per
+* loop iteration, instead of PICOQUIC_PACKET_LOOP_SEND_MAX.
+*
+* If zerocopy_pool_size is not zero, the loop allocates that many send
+* buffers and sets SO_ZEROCOPY on the sockets (Linux only). Packets are
+* prepared in a free buffer from the pool, and sends of at least
+* PICOQUIC_PACKET_LOOP_ZEROCOPY_MIN bytes use MSG_ZEROCOPY. The buffer
+* stays in use until the kernel posts the completion notification on the
+* socket error queue. If all buffers are in use, the loop falls back to
+* copying sends. This requires GSO and epoll, and is not used when
+* batch_depth is larger than 1.
+*
+* If use_receive_timestamps is set, the loop requests kernel receive
+* timestamps on the sockets, using SO_TIMESTAMPING on Linux or SO_TIMESTAMP
+* on BSD and macOS, and passes them to picoquic_incoming_packet_ts. The RTT
+* samples and delivery rate estimates then exclude the delay between the
+* arrival of the packet and its processing by the loop. Timestamps earlier
+* than the previous call to the stack are moved up to that time.
+*
+* If metrics_port is not zero, the loop starts an OpenMetrics endpoint on
+* that TCP port, serving the context metrics over HTTP from a separate thread,
+* see picoquic_start_metrics_server. The endpoint listens on the loopback
+* address, unless metrics_bind_any is set.
+*
+* If busy_poll_budget is not zero, the loop does not block as soon as the
+* sockets are empty. It keeps polling them without waiting for up to
+* busy_poll_budget microseconds, or until the next wake up time, and only
+* then falls back to a blocking wait. The spinning restarts after each
+* packet or wake up. On Linux, the sockets are also set with SO_BUSY_POLL
+* (PICOQUIC_PACKET_LOOP_BUSY_POLL_USEC) and SO_PREFER_BUSY_POLL, so that the
+* non blocking reads poll the device queue directly. Values of SO_BUSY_POLL
+* larger than net.core.busy_read require CAP_NET_ADMIN; if the option is
+* refused, the loop still spins. This trades a core for a lower wake up
+* latency. The time spent spinning is reported in the spin histogram of
+* the loop latencies. Busy poll is only supported by picoquic_packet_loop_v3.
+*
+* If io_provider is not NULL, the loop runs picoquic_packet_loop_provider
+* instead of picoquic_packet_loop_v3, and sends and receives packets through
+* the provider, see picoquic_packet_io_provider_t. The value of
+* io_provider_param is passed to the provider's open function. The options
+* that are specific to the socket loop, such as batch_depth, txtime_horizon
+* or zerocopy_pool_size, are ignored. The providers are not available on
+* Windows.
+*
+* If pin_to_cpu is set, the network thread pins itself to the CPU cpu_index
+* before opening its sockets. If numa_local is set, the thread also asks
+* that the memory it allocates come from its local NUMA node (on Linux, the
+* node of the CPU on which it runs, with a "preferred" memory policy; on
+* Windows, by setting cpu_index as the ideal processor). The sockets, the
+* loop buffers and the objects later allocated by the loop are then local.
+* The QUIC context stays where it was created: applications that want the
+* packet and data node pools on the local node should call
+* picoquic_prewarm_pools from the picoquic_packet_loop_ready callback, which
+* runs in the network thread. With picoquic_start_sharded_server, shard i is
+* pinned to cpu_index + i, which should be chosen so that each shard runs
+* on the node of its NIC queue. Failures to pin are logged but not fatal.
+*
+* If use_dispatcher is set, picoquic_start_sharded_server does not use
+* SO_REUSEPORT. A dispatcher thread owns a single set of sockets, and
+* passes each incoming datagram to the shard encoded in its CID, see
+* picoquic_start_dispatcher. This is not supported on Windows.
+*
+* If wake_up_use_pipe is set, the network thread started with
+* picoquic_start_network_thread is woken up through a pipe even on Linux,
+* where it would otherwise use an eventfd. This is mostly useful to compare
+* the two mechanisms, see thread_tester.
  */
 typedef struct st_picoquic_packet_loop_param_t {
     uint16_t local_port;
@@ -135,6 +385,25 @@ typedef struct st_picoquic_packet_loop_param_t {
     int prefer_extra_socket;
     int simulate_eio;
     size_t send_length_max;
+    int batch_depth;
+    int use_io_uring;
+    int use_rio;
+    int use_select;
+    int reuse_port;
+    int reuseport_steering_shards;
+    uint64_t txtime_horizon;
+    int zerocopy_pool_size;
+    int use_receive_timestamps;
+    uint16_t metrics_port;
+    int metrics_bind_any;
+    uint64_t busy_poll_budget;
+    const struct st_picoquic_packet_io_provider_t* io_provider;
+    void* io_provider_param;
+    int pin_to_cpu;
+    int cpu_index;
+    int numa_local;
+    int use_dispatcher;
+    int wake_up_use_pipe;
 } picoquic_packet_loop_param_t;
 
 int picoquic_packet_loop_v2(picoquic_quic_t* quic,
@@ -158,11 +427,62 @@ int picoquic_packet_loop_v2(picoquic_quic_t* quic,
 * If the application wants to close the network thread, it calls
 * picoquic_close_network_thread, passing the thread context as an argument.
 * The network thread context will be freed during that call.
+*
+* On Linux, the wake up signal uses an eventfd instead of a pipe, unless
+* param->wake_up_use_pipe is set. Both entries of wake_up_pipe_fd then hold
+* the same file descriptor, and wake_up_is_eventfd is set.
 */
 typedef int (*picoquic_custom_thread_create_fn)(void** thread_id, picoquic_thread_fn thread_fn, void* arg);
 typedef void (*picoquic_custom_thread_setname_fn)(char const* thread_name);
 typedef void (*picoquic_custom_thread_delete_fn)(void** thread_id);
 
+/* Commands posted to the network thread.
+*
+* As an alternative to handling everything in the wake up callback,
+* application threads can post commands to the network thread without
+* taking a lock. The commands are queued in a lock free list, and executed
+* in the network thread, in the order in which they were posted, just
+* before the `picoquic_packet_loop_wake_up` callback. The network thread
+* is only woken up if the queue was empty, so a burst of posts causes a
+* single wake up.
+*
+* The application must ensure that the connection is still present when
+* the command executes, i.e., it shall not post commands for a connection
+* after being notified that the connection is closed.
+*/
+typedef enum {
+    picoquic_network_command_add_to_stream = 0, /* picoquic_add_to_stream(cnx, stream_id, data, length, value != 0) */
+    picoquic_network_command_mark_active_stream, /* picoquic_mark_active_stream(cnx, stream_id, value != 0, app_ctx) */
+    picoquic_network_command_mark_datagram_ready, /* picoquic_mark_datagram_ready(cnx, value != 0) */
+    picoquic_network_command_close, /* picoquic_close(cnx, value) */
+    picoquic_network_command_callback, /* command_fn(quic, app_ctx) */
+    picoquic_network_command_queue_datagram /* picoquic_queue_datagram_to_ring(cnx, data, length, (uint8_t)stream_id, value) */
+} picoquic_network_command_enum;
+
+typedef void (*picoquic_network_command_fn)(picoquic_quic_t* quic, void* app_ctx);
+
+typedef struct st_picoquic_network_command_t {
+    struct st_picoquic_network_command_t* next;
+    picoquic_network_command_enum command_type;
+    picoquic_cnx_t* cnx;
+    uint64_t stream_id;
+    uint64_t value;
+    void* app_ctx;
+    picoquic_network_command_fn command_fn;
+    size_t length;
+    uint8_t* data; /* Points to the memory allocated after the command */
+} picoquic_network_command_t;
+
+/* Embedded OpenMetrics endpoint, see metrics_server.c.
+ * The server runs in its own thread, and only reads the snapshots published
+ * by the network thread, see picoquic_get_quic_metrics. It must be stopped
+ * before the quic context is deleted. */
+typedef struct st_picoquic_metrics_server_t picoquic_metrics_server_t;
+
+picoquic_metrics_server_t* picoquic_start_metrics_server(picoquic_quic_t* quic, uint16_t port, int bind_any, int* ret);
+uint16_t picoquic_metrics_server_port(picoquic_metrics_server_t* server);
+void picoquic_stop_metrics_server(picoquic_metrics_server_t* server);
+
 typedef struct st_picoquic_network_thread_ctx_t {
     picoquic_quic_t* quic;
     picoquic_packet_loop_param_t* param;
@@ -176,6 +496,7 @@ typedef struct st_picoquic_network_thread_ctx_t {
     HANDLE wake_up_event;
 #else
     int wake_up_pipe_fd[2];
+    int wake_up_is_eventfd;
 #endif
     int is_threaded;
     int wake_up_defined;
@@ -183,6 +504,10 @@ typedef struct st_picoquic_network_thread_ctx_t {
     volatile int thread_should_close;
     volatile int thread_is_closed;
     int return_code;
+    picoquic_network_command_t* volatile command_head; /* Most recently posted command */
+    picoquic_metrics_server_t* metrics_server; /* If param->metrics_port is set */
+    void* volatile io_ctx; /* Context of the packet I/O provider, if any */
+    volatile int io_wake_up_requested; /* Set instead of the wake up pipe if the provider has a wake function */
 } picoquic_network_thread_ctx_t;
 
 picoquic_network_thread_ctx_t* picoquic_start_network_thread(
@@ -195,6 +520,24 @@ picoquic_network_thread_ctx_t* picoquic_start_network_thread(
 int picoquic_wake_up_network_thread(picoquic_network_thread_ctx_t* thread_ctx);
 void picoquic_delete_network_thread(picoquic_network_thread_ctx_t* thread_ctx);
 
+/* Allocate a command with room for data_length bytes of data. Once posted,
+ * the command belongs to the network thread, which frees it after execution. */
+picoquic_network_command_t* picoquic_create_network_command(picoquic_network_command_enum command_type,
+    picoquic_cnx_t* cnx, size_t data_length);
+int picoquic_post_network_command(picoquic_network_thread_ctx_t* thread_ctx, picoquic_network_command_t* command);
+int picoquic_post_add_to_stream(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx,
+    uint64_t stream_id, const uint8_t* data, size_t length, int set_fin);
+int picoquic_post_mark_active_stream(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx,
+    uint64_t stream_id, int is_active, void* v_stream_ctx);
+int picoquic_post_mark_datagram_ready(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx, int is_ready);
+int picoquic_post_datagram_to_ring(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx,
+    const uint8_t* data, size_t length, uint8_t priority, uint64_t expiry_time);
+int picoquic_post_close(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx, uint64_t application_reason_code);
+int picoquic_post_network_callback(picoquic_network_thread_ctx_t* thread_ctx,
+    picoquic_network_command_fn command_fn, void* app_ctx);
+/* Execute the queued commands. Called by the packet loops in the network thread. */
+void picoquic_run_network_commands(picoquic_network_thread_ctx_t* thread_ctx);
+
 /* The function picoquic_start_network_thread creates a background thread using
 * the "native" threading APIs, CreateThread in Windows or pthread_create in
 * Unix/Posix systems. This will not work in some environments, if for example
@@ -282,6 +625,111 @@ int picoquic_internal_thread_create(void** pthread,
 void picoquic_internal_thread_delete(void** pthread);
 void picoquic_internal_thread_setname(char const * thread_name);
 
+/* Sharded server. A single QUIC context runs on a single network thread,
+* which limits a server to one core. The sharded server creates nb_shards
+* QUIC contexts, each with its own network thread and its own SO_REUSEPORT
+* sockets bound to param->local_port, which must not be zero.
+*
+* The QUIC contexts are created by calling quic_create_fn(shard_id, quic_create_ctx)
+* for each shard. The sharded server configures each context to generate
+* connection IDs using picoquic_lb_compat_cid_generate, with the "clear"
+* method and a one byte server ID set to the shard index, so that the
+* second byte of the CID carries the shard index. The local CID length must
+* be at least 2, and the context must not already use a CID callback.
+*
+* On Linux, the sockets of the first shard get a classic BPF program that
+* steers incoming packets to the socket of rank DCID[1] % nb_shards in the
+* port group. This works for short headers and, because the shard of the
+* first Initial packet encodes its own index in the CIDs it issues, for
+* the long headers sent by the client as well. The shards are started one
+* after the other, so the rank of each socket in the group matches the shard
+* index. On other systems the kernel distributes packets by hash, and only
+* the connections whose 4-tuple does not change are served correctly.
+*
+* loop_callback_ctx may be NULL, or point to an array of nb_shards contexts,
+* passed to the loop callback of the corresponding shard.
+*
+* The sharded server owns the QUIC contexts, which are freed by
+* picoquic_delete_sharded_server after the network threads stop.
+*
+* If param->use_dispatcher is set, the shards share the sockets of a
+* dispatcher instead, and param->local_port may be zero. The port is
+* then obtained with picoquic_dispatcher_port(sharded_server->dispatcher).
+*/
+#define PICOQUIC_SHARDS_MAX 256
+
+typedef picoquic_quic_t* (*picoquic_shard_quic_create_fn)(int shard_id, void* quic_create_ctx);
+
+typedef struct st_picoquic_dispatcher_t picoquic_dispatcher_t;
+
+typedef struct st_picoquic_dispatch_worker_param_t {
+    picoquic_dispatcher_t* dispatcher;
+    int worker_id;
+} picoquic_dispatch_worker_param_t;
+
+typedef struct st_picoquic_sharded_server_t {
+    int nb_shards;
+    picoquic_quic_t** quic;
+    picoquic_packet_loop_param_t* param;
+    picoquic_network_thread_ctx_t** thread_ctx;
+    picoquic_dispatcher_t* dispatcher; /* If param->use_dispatcher is set */
+    picoquic_dispatch_worker_param_t* worker_param;
+} picoquic_sharded_server_t;
+
+picoquic_sharded_server_t* picoquic_start_sharded_server(int nb_shards,
+    picoquic_packet_loop_param_t* param,
+    picoquic_shard_quic_create_fn quic_create_fn,
+    void* quic_create_ctx,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void** loop_callback_ctx,
+    int* ret);
+void picoquic_delete_sharded_server(picoquic_sharded_server_t* sharded_server);
+
+/* Implementation of picoquic_shard_quic_create_fn for QUIC groups, see
+* picoquic_create_quic_group. Pass the group as quic_create_ctx. Each shard
+* is released from the group and owned by the sharded server. The group must
+* have exactly nb_shards shards, and must be created without CID callback.
+* It can be deleted after the sharded server starts.
+*/
+picoquic_quic_t* picoquic_quic_group_shard_create(int shard_id, void* quic_create_ctx);
+
+/* Dispatcher, for servers in which several workers share the same socket,
+* for example in containers that do not allow SO_REUSEPORT.
+*
+* picoquic_start_dispatcher opens the sockets as specified by param, like
+* the socket loop would, and starts a receive thread. That thread reads the
+* incoming datagrams and pushes each of them to the single producer, single
+* consumer ring of the worker returned by picoquic_dispatch_worker_index,
+* i.e., DCID[1] modulo nb_workers, or worker 0 if the CID is shorter than
+* two bytes. This matches the CID layout set by the sharded server. If the
+* ring of a worker holds PICOQUIC_DISPATCH_RING_SIZE datagrams, the next
+* ones are dropped. UDP GRO is not requested on the dispatcher sockets.
+*
+* Each worker runs a packet loop with io_provider set to
+* picoquic_dispatch_io_provider and io_provider_param pointing to a
+* picoquic_dispatch_worker_param_t, see picoquic_dispatcher_worker_param.
+* The worker takes the packets from its ring without copying them, and
+* sends its packets directly on the shared sockets. The dispatcher only
+* signals a worker when it is blocked waiting for packets, once per batch.
+*
+* The workers must be stopped before picoquic_delete_dispatcher is called.
+* The dispatcher is not available on Windows.
+*/
+#define PICOQUIC_DISPATCH_RING_SIZE 1024
+
+picoquic_dispatcher_t* picoquic_start_dispatcher(picoquic_packet_loop_param_t* param, int nb_workers, int* ret);
+void picoquic_delete_dispatcher(picoquic_dispatcher_t* dispatcher);
+uint16_t picoquic_dispatcher_port(picoquic_dispatcher_t* dispatcher);
+int picoquic_dispatcher_worker_param(picoquic_dispatcher_t* dispatcher, int worker_id,
+    picoquic_dispatch_worker_param_t* worker_param);
+/* Number of datagrams passed to the ring of the worker, and dropped because the ring was full */
+void picoquic_get_dispatcher_stats(picoquic_dispatcher_t* dispatcher, int worker_id,
+    uint64_t* nb_dispatched, uint64_t* nb_dropped);
+int picoquic_dispatch_worker_index(const uint8_t* bytes, size_t length, int nb_workers);
+#ifndef _WINDOWS
+extern const picoquic_packet_io_provider_t picoquic_dispatch_io_provider;
+#endif
+
 /* Legacy versions the packet loop, one portable and one specialized
  * for winsock. Keeping these API for compatibility, but the implementation
  * redirects to picoquic_packet_loop_v2.
@@ -310,6 +758,29 @@ void picoquic_packet_loop_close_socket(picoquic_socket_ctx_t* s_ctx);
 int picoquic_packet_loop_open_sockets(uint16_t local_port, int local_af, int socket_buffer_size, int extra_socket_required,
     int do_not_use_gso, picoquic_socket_ctx_t* s_ctx);
 
+/* Following declarations are shared between the variants of the packet loop. */
+#ifdef _WINDOWS
+DWORD WINAPI picoquic_packet_loop_v3(LPVOID v_ctx);
+DWORD WINAPI picoquic_packet_loop_rio(LPVOID v_ctx);
+void picoquic_sockloop_win_coalescing_test(int* recv_coalesced, int* send_coalesced);
+#else
+void* picoquic_packet_loop_v3(void* v_ctx);
+void* picoquic_packet_loop_uring(void* v_ctx);
+void* picoquic_packet_loop_provider(void* v_ctx);
+#endif
+void picoquic_packet_loop_set_affinity(picoquic_packet_loop_param_t* param);
+int picoquic_packet_loop_monitor_system_call_duration(packet_loop_system_call_duration_t* sc_duration,
+    uint64_t current_time, uint64_t previous_time);
+SOCKET_TYPE picoquic_packet_loop_get_send_socket(picoquic_socket_ctx_t* s_ctx, int nb_sockets,
+    picoquic_packet_loop_param_t* param, struct sockaddr_storage* peer_addr, struct sockaddr_storage* local_addr);
+void picoquic_packet_loop_send_error(picoquic_quic_t* quic, picoquic_cnx_t* last_cnx,
+    picoquic_connection_id_t* log_cid, SOCKET_TYPE send_socket,
+    struct sockaddr_storage* peer_addr, struct sockaddr_storage* local_addr, int if_index,
+    const uint8_t* send_buffer, size_t send_length, size_t send_msg_size,
+    int sock_ret, int sock_err, size_t** send_msg_ptr, uint64_t current_time);
+picoquic_cnx_t* picoquic_packet_loop_check_cnx(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
+    picoquic_connection_id_t* log_cid);
+
 #ifdef __cplusplus
 }
 #endif
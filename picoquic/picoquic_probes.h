@@ -0,0 +1,71 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef PICOQUIC_PROBES_H
+#define PICOQUIC_PROBES_H
+
+/*
+* Static tracepoints on the hot paths.
+*
+* When building with PICOQUIC_WITH_USDT, see the WITH_USDT option in
+* CMakeLists.txt, the probes are compiled as USDT probes using sys/sdt.h.
+* Each probe costs a single "nop" instruction until a tracer attaches to
+* it, for example:
+*
+*     bpftrace -e 'usdt:./picoquicdemo:picoquic:packet_lost { @[arg3] = count(); }'
+*
+* Without PICOQUIC_WITH_USDT, the probes compile to nothing and their
+* arguments are not evaluated. Connection contexts are passed as pointers,
+* which tracers can use as connection identifiers.
+*
+* The probes are:
+* - incoming_segment(cnx, ptype, pn64, consumed, ret), after each segment
+*   is processed by picoquic_incoming_segment,
+* - prepare_packet(cnx, send_length, send_msg_size, next_wake_time, ret),
+*   at the end of picoquic_prepare_packet_ex,
+* - retransmit_needed(cnx, pc, length, next_wake_time), at the end of
+*   picoquic_retransmit_needed,
+* - packet_lost(cnx, unique_path_id, sequence_number, ptype, length, timer_based),
+*   when a packet is declared lost,
+* - cc_notify(cnx, unique_path_id, notification, cwin), after each
+*   notification of the congestion control algorithm,
+* - socks_cmsg_parse(received_ecn, udp_coalesced_size, receive_time), after
+*   parsing the control data received with a datagram.
+*/
+
+#ifdef PICOQUIC_WITH_USDT
+#include <sys/sdt.h>
+#define PICOQUIC_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(picoquic, name, a1, a2, a3)
+#define PICOQUIC_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(picoquic, name, a1, a2, a3, a4)
+#define PICOQUIC_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(picoquic, name, a1, a2, a3, a4, a5)
+#define PICOQUIC_PROBE6(name, a1, a2, a3, a4, a5, a6) DTRACE_PROBE6(picoquic, name, a1, a2, a3, a4, a5, a6)
+#else
+#define PICOQUIC_PROBE3(name, a1, a2, a3) do {} while (0)
+#define PICOQUIC_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#define PICOQUIC_PROBE5(name, a1, a2, a3, a4, a5) do {} while (0)
+#define PICOQUIC_PROBE6(name, a1, a2, a3, a4, a5, a6) do {} while (0)
+#endif
+
+#define PICOQUIC_PROBE_CC_NOTIFY(cnx, path_x, notification) \
+    PICOQUIC_PROBE4(cc_notify, cnx, (path_x)->unique_path_id, (int)(notification), (path_x)->cwin)
+
+#endif /* PICOQUIC_PROBES_H */
@@ -288,6 +288,104 @@ ptls_verify_certificate_t* picoquic_openssl_get_certificate_verifier(char const*
     return verify_cert;
 }
 
+/* Verify the handshake signature with the public key of a leaf certificate
+ * that was validated previously, for the certificate verification cache.
+ * As in the picotls verifier, the verify context is the public key, which is
+ * released after the call, or when the call is made with an empty data. */
+static int picoquic_openssl_verify_sign(void* verify_ctx, uint16_t algo, ptls_iovec_t data, ptls_iovec_t signature)
+{
+    EVP_PKEY* key = (EVP_PKEY*)verify_ctx;
+    int ret = 0;
+
+    if (data.base != NULL) {
+        int key_id = EVP_PKEY_id(key);
+        const EVP_MD* md = NULL;
+        EVP_MD_CTX* md_ctx = NULL;
+        EVP_PKEY_CTX* pkey_ctx = NULL;
+
+        switch (algo) {
+        case PTLS_SIGNATURE_ECDSA_SECP256R1_SHA256:
+            md = (key_id == EVP_PKEY_EC) ? EVP_sha256() : NULL;
+            break;
+        case PTLS_SIGNATURE_ECDSA_SECP384R1_SHA384:
+            md = (key_id == EVP_PKEY_EC) ? EVP_sha384() : NULL;
+            break;
+        case PTLS_SIGNATURE_ECDSA_SECP521R1_SHA512:
+            md = (key_id == EVP_PKEY_EC) ? EVP_sha512() : NULL;
+            break;
+        case PTLS_SIGNATURE_RSA_PSS_RSAE_SHA256:
+            md = (key_id == EVP_PKEY_RSA) ? EVP_sha256() : NULL;
+            break;
+        case PTLS_SIGNATURE_RSA_PSS_RSAE_SHA384:
+            md = (key_id == EVP_PKEY_RSA) ? EVP_sha384() : NULL;
+            break;
+        case PTLS_SIGNATURE_RSA_PSS_RSAE_SHA512:
+            md = (key_id == EVP_PKEY_RSA) ? EVP_sha512() : NULL;
+            break;
+        default:
+            break;
+        }
+
+        if ((md_ctx = EVP_MD_CTX_create()) == NULL) {
+            ret = PTLS_ERROR_NO_MEMORY;
+        }
+#ifdef EVP_PKEY_ED25519
+        else if (algo == PTLS_SIGNATURE_ED25519 && key_id == EVP_PKEY_ED25519) {
+            if (EVP_DigestVerifyInit(md_ctx, &pkey_ctx, NULL, NULL, key) != 1) {
+                ret = PTLS_ERROR_LIBRARY;
+            }
+            else if (EVP_DigestVerify(md_ctx, signature.base, signature.len, data.base, data.len) != 1) {
+                ret = PTLS_ALERT_DECRYPT_ERROR;
+            }
+        }
+#endif
+        else if (md == NULL) {
+            ret = PTLS_ALERT_ILLEGAL_PARAMETER;
+        }
+        else if (EVP_DigestVerifyInit(md_ctx, &pkey_ctx, md, NULL, key) != 1) {
+            ret = PTLS_ERROR_LIBRARY;
+        }
+        else if (key_id == EVP_PKEY_RSA && (EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, RSA_PKCS1_PSS_PADDING) != 1 ||
+            EVP_PKEY_CTX_set_rsa_pss_saltlen(pkey_ctx, -1) != 1 ||
+            EVP_PKEY_CTX_set_rsa_mgf1_md(pkey_ctx, md) != 1)) {
+            ret = PTLS_ERROR_LIBRARY;
+        }
+        else if (EVP_DigestVerifyUpdate(md_ctx, data.base, data.len) != 1) {
+            ret = PTLS_ERROR_LIBRARY;
+        }
+        else if (EVP_DigestVerifyFinal(md_ctx, signature.base, signature.len) != 1) {
+            ret = PTLS_ALERT_DECRYPT_ERROR;
+        }
+
+        if (md_ctx != NULL) {
+            EVP_MD_CTX_destroy(md_ctx);
+        }
+    }
+    EVP_PKEY_free(key);
+
+    return ret;
+}
+
+static int picoquic_openssl_get_leaf_sign_verifier(ptls_iovec_t leaf, picoquic_verify_sign_t* verify_sign, void** verify_data)
+{
+    int ret = -1;
+    const uint8_t* leaf_bytes = leaf.base;
+    X509* cert = d2i_X509(NULL, &leaf_bytes, (long)leaf.len);
+
+    if (cert != NULL) {
+        EVP_PKEY* key = X509_get_pubkey(cert);
+
+        if (key != NULL) {
+            *verify_sign = picoquic_openssl_verify_sign;
+            *verify_data = key;
+            ret = 0;
+        }
+        X509_free(cert);
+    }
+
+    return ret;
+}
+
 /* Set the list of root certificates used by the client.
 * This implementation is specific to OpenSSL, because it is tied to the 
 * implementation of the verify certificate function. */
@@ -435,6 +533,7 @@ void picoquic_ptls_openssl_load(int unload)
         picoquic_register_verify_certificate_fn(picoquic_openssl_get_certificate_verifier,
             picoquic_openssl_dispose_certificate_verifier,
             picoquic_openssl_set_tls_root_certificates);
+        picoquic_register_leaf_sign_verifier_fn(picoquic_openssl_get_leaf_sign_verifier);
         picoquic_register_explain_crypto_error_fn(picoquic_open_ssl_explain_crypto_error,
             picoquic_openssl_clear_crypto_errors);
         picoquic_register_crypto_random_provider_fn(ptls_openssl_random_bytes);
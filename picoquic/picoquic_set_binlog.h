@@ -31,6 +31,101 @@ extern "C" {
     */
 int picoquic_set_binlog(picoquic_quic_t* quic, char const* binlog_dir);
 
+/* Write the binary logs from a separate thread.
+ * The network thread composes the log records and queues them in a ring
+ * buffer of ring_size bytes, rounded up to a power of 2, or 1MB if ring_size
+ * is zero. A writer thread copies the records to the log files, so that
+ * the network thread never waits for the disk, except if the policy is
+ * picoquic_binlog_async_block and the ring is full. With the policy
+ * picoquic_binlog_async_drop, records that do not fit in the ring are
+ * dropped and counted in the statistics.
+ * The writer is stopped, after writing all pending records, when the
+ * QUIC context is freed. Must be called before the first connection is
+ * created.
+ */
+typedef enum {
+    picoquic_binlog_async_drop = 0,
+    picoquic_binlog_async_block
+} picoquic_binlog_async_policy_enum;
+
+typedef struct st_picoquic_binlog_async_stats_t {
+    size_t ring_size;
+    uint64_t nb_records;
+    uint64_t nb_bytes;
+    uint64_t nb_records_dropped;
+    uint64_t nb_bytes_dropped;
+    uint64_t nb_producer_waits;
+    uint64_t max_ring_fill;
+    uint64_t nb_records_direct; /* Encoded in place in the ring, without intermediate copies */
+} picoquic_binlog_async_stats_t;
+
+int picoquic_set_binlog_async(picoquic_quic_t* quic, size_t ring_size, picoquic_binlog_async_policy_enum policy);
+void picoquic_get_binlog_async_stats(picoquic_quic_t* quic, picoquic_binlog_async_stats_t* stats);
+
+/* Write the binary logs in the compressed format, version 2.
+ * The records of each connection are accumulated in memory, in blocks
+ * of about block_size bytes, between 4KB and 1MB. 64KB is a good value.
+ * The blocks are compressed and written one at a time, with an index of the connection
+ * IDs and of the time range found in the block. Blocks are compressed by
+ * the writer thread if picoquic_set_binlog_async is also used, and are
+ * then limited to a quarter of the ring size. The log
+ * readers in loglib handle both formats. Setting block_size to 0 reverts
+ * to the uncompressed format for the next connections.
+ */
+int picoquic_set_binlog_compression(picoquic_quic_t* quic, size_t block_size);
+
+/* Select which connections are logged in binary logs, and thus in qlogs.
+ * - sample_one_in_n: if larger than 1, only log one connection in N.
+ * - sni, alpn: if not NULL, only log connections with that SNI or ALPN.
+ *   On the server, these values are only known after the client hello,
+ *   so the first records are held in memory until then.
+ * - cid_prefix: if id_len > 0, only log connections whose initial CID
+ *   starts with these bytes.
+ * - flight_recorder_duration: if not zero, records are kept in memory
+ *   instead of being written to disk. The handshake records are always
+ *   kept, the other records for that many microseconds, within a budget
+ *   of flight_recorder_max_bytes per connection (default 256KB). The
+ *   records are written to the log file only if one of the triggers fires,
+ *   after which the connection logs directly to the file.
+ * - triggers: combination of picoquic_log_trigger_enum values.
+ * - spurious_storm_threshold: number of spurious retransmissions within
+ *   flight_recorder_duration that fires the trigger (default 8).
+ * - rtt_spike_factor: the trigger fires if an RTT sample is larger than
+ *   that multiple of the min RTT (default 4).
+ * Passing a NULL policy logs all connections again. The binary log or qlog
+ * folder must be set separately.
+ */
+typedef enum {
+    picoquic_log_trigger_close_error = 1,
+    picoquic_log_trigger_spurious_storm = 2,
+    picoquic_log_trigger_rtt_spike = 4
+} picoquic_log_trigger_enum;
+
+typedef struct st_picoquic_log_policy_t {
+    uint32_t sample_one_in_n;
+    char const* sni;
+    char const* alpn;
+    picoquic_connection_id_t cid_prefix;
+    uint64_t flight_recorder_duration;
+    size_t flight_recorder_max_bytes;
+    uint32_t triggers;
+    uint64_t spurious_storm_threshold;
+    uint64_t rtt_spike_factor;
+} picoquic_log_policy_t;
+
+typedef struct st_picoquic_log_policy_stats_t {
+    uint64_t nb_sampled_out;
+    uint64_t nb_filtered_out;
+    uint64_t nb_recorders_flushed;
+    uint64_t nb_recorders_discarded;
+    uint64_t nb_records_dropped;
+} picoquic_log_policy_stats_t;
+
+int picoquic_set_log_policy(picoquic_quic_t* quic, const picoquic_log_policy_t* policy);
+void picoquic_get_log_policy_stats(picoquic_quic_t* quic, picoquic_log_policy_stats_t* stats);
+/* Write the flight recorder content of the connection to its log file now */
+void picoquic_trigger_flight_recorder(picoquic_cnx_t* cnx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,20 @@ extern "C" {
     */
 int picoquic_set_textlog(picoquic_quic_t* quic, char const* textlog_file);
 
+/* Limit the text log to max_lines_per_second events per connection, such
+ * as a packet and its frames. Events beyond the limit are not formatted,
+ * and their number is logged when the next one second window starts.
+ * Set to 0, the default, to log all events.
+ */
+void picoquic_set_textlog_rate_limit(picoquic_quic_t* quic, uint64_t max_lines_per_second);
+
+/* Pass the text log to the asynchronous writer set by picoquic_set_binlog_async,
+ * so the network thread only formats the events in memory. Must be called
+ * after picoquic_set_textlog and picoquic_set_binlog_async. Returns -1 if
+ * either is missing, or on Windows, where memory streams are not available.
+ */
+int picoquic_set_textlog_async(picoquic_quic_t* quic);
+
 #ifdef __cplusplus
 }
 #endif
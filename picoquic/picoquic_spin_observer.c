@@ -0,0 +1,542 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_spin_observer.h"
+
+#define PICOQUIC_SPINOBS_VERSION_1 0x00000001u
+#define PICOQUIC_SPINOBS_VERSION_2 0x6b3343cfu
+#define PICOQUIC_SPINOBS_CID_MAX 20
+/* Smallest short header packet: first byte, 4 bytes sampled for header
+ * protection, and the AEAD tag, with a zero length CID. */
+#define PICOQUIC_SPINOBS_SHORT_MIN 21
+
+#define SPINOBS_PARSE_16(b) (((uint16_t)(b)[0] << 8) | (uint16_t)(b)[1])
+#define SPINOBS_PARSE_32(b) (((uint32_t)SPINOBS_PARSE_16(b) << 16) | (uint32_t)SPINOBS_PARSE_16((b) + 2))
+
+typedef enum {
+    picoquic_spinobs_packet_none = 0,
+    picoquic_spinobs_packet_long,
+    picoquic_spinobs_packet_short
+} picoquic_spinobs_packet_enum;
+
+static uint64_t picoquic_spinobs_mix(uint64_t x)
+{
+    /* Finalizer of splitmix64 */
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t picoquic_spinobs_hash_key(const picoquic_spinobs_t* obs, const picoquic_spinobs_key_t* key)
+{
+    const uint8_t* bytes = (const uint8_t*)key;
+    uint64_t h = 0xcbf29ce484222325ull ^ obs->hash_seed;
+
+    for (size_t i = 0; i < sizeof(picoquic_spinobs_key_t); i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ull;
+    }
+    h = picoquic_spinobs_mix(h);
+
+    return (h == 0) ? 1 : h;
+}
+
+int picoquic_spinobs_init(picoquic_spinobs_t* obs, size_t nb_flows_max, uint64_t hash_seed)
+{
+    int ret = 0;
+    size_t nb_flows = PICOQUIC_SPINOBS_PROBE_WINDOW;
+
+    memset(obs, 0, sizeof(picoquic_spinobs_t));
+    while (nb_flows < nb_flows_max && nb_flows < ((size_t)1 << 30)) {
+        nb_flows <<= 1;
+    }
+    obs->flow_hash = (uint64_t*)calloc(nb_flows, sizeof(uint64_t));
+    obs->flows = (picoquic_spinobs_flow_t*)calloc(nb_flows, sizeof(picoquic_spinobs_flow_t));
+    if (obs->flow_hash == NULL || obs->flows == NULL) {
+        picoquic_spinobs_clear(obs);
+        ret = -1;
+    }
+    else {
+        obs->nb_flows_max = nb_flows;
+        obs->hash_seed = hash_seed;
+        obs->idle_timeout = PICOQUIC_SPINOBS_FLOW_IDLE;
+    }
+
+    return ret;
+}
+
+void picoquic_spinobs_clear(picoquic_spinobs_t* obs)
+{
+    if (obs->flow_hash != NULL) {
+        free(obs->flow_hash);
+    }
+    if (obs->flows != NULL) {
+        free(obs->flows);
+    }
+    memset(obs, 0, sizeof(picoquic_spinobs_t));
+}
+
+void picoquic_spinobs_set_flow_end_callback(picoquic_spinobs_t* obs, picoquic_spinobs_flow_end_fn flow_end_fn, void* flow_end_ctx)
+{
+    obs->flow_end_fn = flow_end_fn;
+    obs->flow_end_ctx = flow_end_ctx;
+}
+
+static void picoquic_spinobs_end_flow(picoquic_spinobs_t* obs, size_t slot)
+{
+    if (obs->flow_end_fn != NULL) {
+        obs->flow_end_fn(obs, &obs->flows[slot], obs->flow_end_ctx);
+    }
+    obs->flow_hash[slot] = 0;
+}
+
+/* Find the flow in the probe window. If it is not there and "create" is set,
+ * use the first free slot, else the first expired one, else the one idle for
+ * the longest time. */
+static picoquic_spinobs_flow_t* picoquic_spinobs_find_flow(picoquic_spinobs_t* obs, const picoquic_spinobs_key_t* key,
+    int create, uint64_t current_time)
+{
+    uint64_t h = picoquic_spinobs_hash_key(obs, key);
+    size_t mask = obs->nb_flows_max - 1;
+    size_t first = (size_t)h & mask;
+    picoquic_spinobs_flow_t* flow = NULL;
+
+    for (size_t i = 0; i < PICOQUIC_SPINOBS_PROBE_WINDOW; i++) {
+        size_t slot = (first + i) & mask;
+        if (obs->flow_hash[slot] == h && memcmp(&obs->flows[slot].key, key, sizeof(picoquic_spinobs_key_t)) == 0) {
+            flow = &obs->flows[slot];
+            break;
+        }
+    }
+
+    if (flow == NULL && create) {
+        size_t candidate = first;
+        int is_free = 0;
+
+        for (size_t i = 0; i < PICOQUIC_SPINOBS_PROBE_WINDOW; i++) {
+            size_t slot = (first + i) & mask;
+            if (obs->flow_hash[slot] == 0) {
+                candidate = slot;
+                is_free = 1;
+                break;
+            }
+            else if (obs->flows[slot].last_time < obs->flows[candidate].last_time) {
+                candidate = slot;
+            }
+        }
+
+        if (!is_free) {
+            if (obs->flows[candidate].last_time + obs->idle_timeout < current_time) {
+                obs->nb_flows_expired++;
+            }
+            else {
+                obs->nb_flows_evicted++;
+            }
+            picoquic_spinobs_end_flow(obs, candidate);
+        }
+        flow = &obs->flows[candidate];
+        memset(flow, 0, sizeof(picoquic_spinobs_flow_t));
+        memcpy(&flow->key, key, sizeof(picoquic_spinobs_key_t));
+        flow->first_time = current_time;
+        obs->flow_hash[candidate] = h;
+        obs->nb_flows_created++;
+    }
+
+    return flow;
+}
+
+static const uint8_t* picoquic_spinobs_varint_skip(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* value)
+{
+    if (bytes < bytes_max) {
+        size_t length = (size_t)1 << (bytes[0] >> 6);
+
+        if (bytes + length > bytes_max) {
+            bytes = NULL;
+        }
+        else {
+            uint64_t v = bytes[0] & 0x3f;
+            for (size_t i = 1; i < length; i++) {
+                v = (v << 8) | bytes[i];
+            }
+            *value = v;
+            bytes += length;
+        }
+    }
+    else {
+        bytes = NULL;
+    }
+
+    return bytes;
+}
+
+/* Walk through the coalesced packets of a datagram, using the same layout
+ * as picoquic_parse_long_packet_header, but without a connection context.
+ * The short header packet, if any, is the last one. Long header packets of
+ * unknown versions cannot be skipped, so the parsing stops there. */
+static picoquic_spinobs_packet_enum picoquic_spinobs_parse_datagram(const uint8_t* bytes, size_t length, int* spin)
+{
+    picoquic_spinobs_packet_enum last_type = picoquic_spinobs_packet_none;
+    const uint8_t* bytes_max = bytes + length;
+
+    while (bytes != NULL && bytes < bytes_max) {
+        if ((bytes[0] & 0x80) == 0) {
+            if ((bytes[0] & 0x40) != 0 && (size_t)(bytes_max - bytes) >= PICOQUIC_SPINOBS_SHORT_MIN) {
+                *spin = (bytes[0] >> 5) & 1;
+                last_type = picoquic_spinobs_packet_short;
+            }
+            break;
+        }
+        else if (bytes_max - bytes < 7) {
+            break;
+        }
+        else {
+            uint8_t flags = bytes[0];
+            uint32_t vn = SPINOBS_PARSE_32(bytes + 1);
+            const uint8_t* next = bytes + 5;
+            int long_type = (flags >> 4) & 3;
+            uint64_t payload_length = 0;
+
+            if (next[0] > PICOQUIC_SPINOBS_CID_MAX || next + 1 + next[0] >= bytes_max) {
+                break;
+            }
+            next += 1 + next[0];
+            if (next[0] > PICOQUIC_SPINOBS_CID_MAX || next + 1 + next[0] > bytes_max) {
+                break;
+            }
+            next += 1 + next[0];
+            last_type = picoquic_spinobs_packet_long;
+
+            if (vn == PICOQUIC_SPINOBS_VERSION_2) {
+                /* Version 2 rotates the packet types */
+                long_type = (long_type + 3) & 3;
+            }
+            else if (vn != PICOQUIC_SPINOBS_VERSION_1) {
+                /* Version negotiation, or unknown version */
+                break;
+            }
+
+            if (long_type == 3) {
+                /* Retry, no length field */
+                break;
+            }
+            if (long_type == 0) {
+                uint64_t token_length = 0;
+                if ((next = picoquic_spinobs_varint_skip(next, bytes_max, &token_length)) == NULL ||
+                    token_length > (uint64_t)(bytes_max - next)) {
+                    break;
+                }
+                next += token_length;
+            }
+            if ((next = picoquic_spinobs_varint_skip(next, bytes_max, &payload_length)) == NULL ||
+                payload_length > (uint64_t)(bytes_max - next)) {
+                break;
+            }
+            bytes = next + payload_length;
+        }
+    }
+
+    return last_type;
+}
+
+static void picoquic_spinobs_add_sample(picoquic_spinobs_t* obs, picoquic_spinobs_flow_t* flow, uint64_t rtt)
+{
+    if (flow->nb_samples == 0 || rtt < flow->rtt_min) {
+        flow->rtt_min = rtt;
+    }
+    if (rtt > flow->rtt_max) {
+        flow->rtt_max = rtt;
+    }
+    flow->rtt_sum += rtt;
+    flow->nb_samples++;
+    flow->histogram[picoquic_spinobs_bucket_index(rtt)]++;
+    obs->nb_samples++;
+}
+
+static void picoquic_spinobs_process_spin(picoquic_spinobs_t* obs, picoquic_spinobs_flow_t* flow, int direction,
+    int spin, uint64_t current_time)
+{
+    picoquic_spinobs_direction_t* dir = &flow->direction[direction];
+
+    dir->nb_packets++;
+    if (!dir->has_spin) {
+        dir->has_spin = 1;
+        dir->spin = spin;
+    }
+    else if (dir->spin != (unsigned int)spin) {
+        flow->nb_edges++;
+        if (!dir->has_edge) {
+            dir->has_edge = 1;
+            dir->last_edge_time = current_time;
+            dir->spin = spin;
+        }
+        else {
+            uint64_t delta = (current_time > dir->last_edge_time) ? current_time - dir->last_edge_time : 0;
+
+            if (flow->nb_samples > 0 && delta < flow->rtt_min / 8) {
+                /* Most likely a reordered packet from the previous period. */
+                flow->nb_edges_rejected++;
+            }
+            else {
+                if (delta > PICOQUIC_SPINOBS_RTT_MAX) {
+                    flow->nb_edges_rejected++;
+                }
+                else {
+                    picoquic_spinobs_add_sample(obs, flow, delta);
+                }
+                dir->last_edge_time = current_time;
+                dir->spin = spin;
+            }
+        }
+    }
+}
+
+int picoquic_spinobs_process_udp(picoquic_spinobs_t* obs, uint8_t ip_version,
+    const uint8_t* src_addr, uint16_t src_port, const uint8_t* dst_addr, uint16_t dst_port,
+    const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+    int spin = 0;
+    picoquic_spinobs_packet_enum packet_type = picoquic_spinobs_parse_datagram(bytes, length, &spin);
+
+    obs->nb_datagrams++;
+    if (packet_type == picoquic_spinobs_packet_none) {
+        obs->nb_not_quic++;
+        ret = -1;
+    }
+    else {
+        picoquic_spinobs_key_t key;
+        picoquic_spinobs_flow_t* flow;
+        size_t addr_length = (ip_version == 6) ? 16 : 4;
+        int direction = 0;
+        int cmp = memcmp(src_addr, dst_addr, addr_length);
+
+        if (cmp > 0 || (cmp == 0 && src_port > dst_port)) {
+            direction = 1;
+        }
+        memset(&key, 0, sizeof(key));
+        key.ip_version = ip_version;
+        memcpy(key.addr[direction], src_addr, addr_length);
+        memcpy(key.addr[1 - direction], dst_addr, addr_length);
+        key.port[direction] = src_port;
+        key.port[1 - direction] = dst_port;
+
+        flow = picoquic_spinobs_find_flow(obs, &key,
+            packet_type == picoquic_spinobs_packet_long || obs->create_on_short_header, current_time);
+        if (flow != NULL) {
+            flow->last_time = current_time;
+            if (packet_type == picoquic_spinobs_packet_short) {
+                obs->nb_short_packets++;
+                picoquic_spinobs_process_spin(obs, flow, direction, spin, current_time);
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_spinobs_process_ip(picoquic_spinobs_t* obs, const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    int ret = -1;
+    int ip_version = (length > 0) ? bytes[0] >> 4 : 0;
+    const uint8_t* src_addr = NULL;
+    const uint8_t* dst_addr = NULL;
+    size_t offset = 0;
+
+    if (ip_version == 4 && length >= 20) {
+        size_t header_length = 4 * (size_t)(bytes[0] & 0x0f);
+        size_t total_length = SPINOBS_PARSE_16(bytes + 2);
+
+        /* Fragments are ignored */
+        if (bytes[9] == 17 && (SPINOBS_PARSE_16(bytes + 6) & 0x3fff) == 0 &&
+            header_length >= 20 && total_length >= header_length && total_length <= length) {
+            src_addr = bytes + 12;
+            dst_addr = bytes + 16;
+            length = total_length;
+            offset = header_length;
+            ret = 0;
+        }
+    }
+    else if (ip_version == 6 && length >= 40) {
+        size_t total_length = 40 + (size_t)SPINOBS_PARSE_16(bytes + 4);
+
+        /* Extension headers are not supported */
+        if (bytes[6] == 17 && total_length <= length) {
+            src_addr = bytes + 8;
+            dst_addr = bytes + 24;
+            length = total_length;
+            offset = 40;
+            ret = 0;
+        }
+    }
+
+    if (ret == 0) {
+        size_t udp_length;
+
+        if (offset + 8 > length || (udp_length = SPINOBS_PARSE_16(bytes + offset + 4)) < 8 ||
+            offset + udp_length > length) {
+            ret = -1;
+        }
+        else {
+            ret = picoquic_spinobs_process_udp(obs, (uint8_t)ip_version,
+                src_addr, SPINOBS_PARSE_16(bytes + offset), dst_addr, SPINOBS_PARSE_16(bytes + offset + 2),
+                bytes + offset + 8, udp_length - 8, current_time);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_spinobs_process_frame(picoquic_spinobs_t* obs, uint32_t link_type, const uint8_t* bytes, size_t length,
+    uint64_t current_time)
+{
+    size_t offset = 0;
+
+    switch (link_type) {
+    case PICOQUIC_SPINOBS_LINKTYPE_NULL:
+        offset = 4;
+        break;
+    case PICOQUIC_SPINOBS_LINKTYPE_ETHERNET:
+        offset = 12;
+        while (offset + 2 <= length && SPINOBS_PARSE_16(bytes + offset) == 0x8100) {
+            /* VLAN tags */
+            offset += 4;
+        }
+        offset += 2;
+        break;
+    case PICOQUIC_SPINOBS_LINKTYPE_RAW:
+    case PICOQUIC_SPINOBS_LINKTYPE_RAW_OPENBSD:
+        break;
+    case PICOQUIC_SPINOBS_LINKTYPE_LINUX_SLL:
+        offset = 16;
+        break;
+    case PICOQUIC_SPINOBS_LINKTYPE_LINUX_SLL2:
+        offset = 20;
+        break;
+    default:
+        offset = length;
+        break;
+    }
+
+    return (offset < length) ? picoquic_spinobs_process_ip(obs, bytes + offset, length - offset, current_time) : -1;
+}
+
+void picoquic_spinobs_expire(picoquic_spinobs_t* obs, uint64_t current_time)
+{
+    for (size_t slot = 0; slot < obs->nb_flows_max; slot++) {
+        if (obs->flow_hash[slot] != 0 && obs->flows[slot].last_time + obs->idle_timeout < current_time) {
+            obs->nb_flows_expired++;
+            picoquic_spinobs_end_flow(obs, slot);
+        }
+    }
+}
+
+void picoquic_spinobs_flush(picoquic_spinobs_t* obs)
+{
+    for (size_t slot = 0; slot < obs->nb_flows_max; slot++) {
+        if (obs->flow_hash[slot] != 0) {
+            picoquic_spinobs_end_flow(obs, slot);
+        }
+    }
+}
+
+const picoquic_spinobs_flow_t* picoquic_spinobs_next_flow(const picoquic_spinobs_t* obs, size_t* index)
+{
+    const picoquic_spinobs_flow_t* flow = NULL;
+
+    while (*index < obs->nb_flows_max) {
+        size_t slot = (*index)++;
+        if (obs->flow_hash[slot] != 0) {
+            flow = &obs->flows[slot];
+            break;
+        }
+    }
+
+    return flow;
+}
+
+int picoquic_spinobs_bucket_index(uint64_t rtt)
+{
+    int bucket_index = 0;
+
+    if (rtt >= (1ull << PICOQUIC_SPINOBS_BUCKET_MIN_LOG)) {
+        int log2 = PICOQUIC_SPINOBS_BUCKET_MIN_LOG;
+
+        while (log2 < 63 && (rtt >> (log2 + 1)) != 0) {
+            log2++;
+        }
+        bucket_index = 1 + 4 * (log2 - PICOQUIC_SPINOBS_BUCKET_MIN_LOG) + (int)((rtt >> (log2 - 2)) & 3);
+        if (bucket_index >= PICOQUIC_SPINOBS_NB_BUCKETS) {
+            bucket_index = PICOQUIC_SPINOBS_NB_BUCKETS - 1;
+        }
+    }
+
+    return bucket_index;
+}
+
+uint64_t picoquic_spinobs_bucket_floor(int bucket_index)
+{
+    uint64_t floor = 0;
+
+    if (bucket_index > 0) {
+        int log2 = PICOQUIC_SPINOBS_BUCKET_MIN_LOG + (bucket_index - 1) / 4;
+        floor = (uint64_t)(4 + (bucket_index - 1) % 4) << (log2 - 2);
+    }
+
+    return floor;
+}
+
+uint64_t picoquic_spinobs_percentile(const picoquic_spinobs_flow_t* flow, int percent)
+{
+    uint64_t rtt = 0;
+
+    if (flow->nb_samples > 0) {
+        uint64_t target = (flow->nb_samples * (uint64_t)percent + 99) / 100;
+        uint64_t cumulative = 0;
+        int bucket_index = 0;
+
+        if (target == 0) {
+            target = 1;
+        }
+        while (bucket_index < PICOQUIC_SPINOBS_NB_BUCKETS - 1) {
+            cumulative += flow->histogram[bucket_index];
+            if (cumulative >= target) {
+                break;
+            }
+            bucket_index++;
+        }
+        rtt = (bucket_index < PICOQUIC_SPINOBS_NB_BUCKETS - 1) ?
+            picoquic_spinobs_bucket_floor(bucket_index + 1) - 1 : flow->rtt_max;
+        if (rtt > flow->rtt_max) {
+            rtt = flow->rtt_max;
+        }
+        if (rtt < flow->rtt_min) {
+            rtt = flow->rtt_min;
+        }
+    }
+
+    return rtt;
+}
@@ -0,0 +1,176 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Passive RTT measurement with the QUIC spin bit.
+*
+* When the spin bit is enabled, the client reflects in its short header
+* packets the spin value received from the server, and the server inverts
+* the value received from the client. Seen from any point on the path, the
+* value thus flips once per round trip in each direction, and the time
+* between two consecutive edges in the same direction is an RTT sample.
+* The observer does not need keys: the spin bit is in the first byte of the
+* short header, which is not protected by encryption.
+*
+* Flows are identified by their addresses and ports, regardless of
+* direction, and kept in a fixed size table allocated at initialization.
+* A flow is looked up by its 64 bit hash in a window of
+* PICOQUIC_SPINOBS_PROBE_WINDOW consecutive slots. The hashes are kept in
+* a separate array, so a lookup reads a single cache line in the common
+* case. If the window is full, the flow that has been idle for the longest
+* time is evicted. Flows that have been idle for longer than the idle
+* timeout are reclaimed, and the optional flow end callback is called
+* before a flow is evicted or reclaimed, so that its statistics can be
+* exported.
+*
+* By default, flows are only created when a long header packet is seen,
+* i.e., at the start of a connection, which filters most of the non QUIC
+* UDP traffic. Observers that start in the middle of connections can set
+* "create_on_short_header".
+*
+* Edges are filtered as follows:
+* - the first edge in each direction only starts the measurement,
+* - an edge that comes less than 1/8th of the smallest RTT sample after
+*   the previous edge is attributed to reordering, and ignored,
+* - samples larger than PICOQUIC_SPINOBS_RTT_MAX are ignored, as they are
+*   more likely to reflect an idle period than the path delay.
+* Endpoints that do not support the spin bit set it to a fixed or random
+* value. Fixed values produce no edges; random values produce many short
+* edges, visible as a high ratio of rejected edges.
+*
+* RTT samples are accumulated in a per flow histogram, with 4 buckets per
+* power of 2 from 128 microseconds, i.e., an accuracy of about 20%.
+*/
+
+#ifndef PICOQUIC_SPIN_OBSERVER_H
+#define PICOQUIC_SPIN_OBSERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICOQUIC_SPINOBS_PROBE_WINDOW 8
+#define PICOQUIC_SPINOBS_FLOW_IDLE 30000000ull
+#define PICOQUIC_SPINOBS_RTT_MAX 10000000ull
+#define PICOQUIC_SPINOBS_NB_BUCKETS 64
+#define PICOQUIC_SPINOBS_BUCKET_MIN_LOG 7
+
+/* Link types, as defined in the pcap format */
+#define PICOQUIC_SPINOBS_LINKTYPE_NULL 0
+#define PICOQUIC_SPINOBS_LINKTYPE_ETHERNET 1
+#define PICOQUIC_SPINOBS_LINKTYPE_RAW_OPENBSD 12
+#define PICOQUIC_SPINOBS_LINKTYPE_RAW 101
+#define PICOQUIC_SPINOBS_LINKTYPE_LINUX_SLL 113
+#define PICOQUIC_SPINOBS_LINKTYPE_LINUX_SLL2 276
+
+/* Flow key. The end points are sorted, so both directions of a flow have
+ * the same key, and direction 0 is from addr[0] to addr[1]. IPv4 addresses
+ * are stored in the first 4 bytes. */
+typedef struct st_picoquic_spinobs_key_t {
+    uint8_t addr[2][16];
+    uint16_t port[2];
+    uint8_t ip_version;
+} picoquic_spinobs_key_t;
+
+typedef struct st_picoquic_spinobs_direction_t {
+    uint64_t nb_packets;
+    uint64_t last_edge_time;
+    unsigned int has_spin : 1;
+    unsigned int has_edge : 1;
+    unsigned int spin : 1;
+} picoquic_spinobs_direction_t;
+
+typedef struct st_picoquic_spinobs_flow_t {
+    picoquic_spinobs_key_t key;
+    uint64_t first_time;
+    uint64_t last_time;
+    uint64_t nb_edges;
+    uint64_t nb_edges_rejected;
+    uint64_t nb_samples;
+    uint64_t rtt_min;
+    uint64_t rtt_max;
+    uint64_t rtt_sum;
+    picoquic_spinobs_direction_t direction[2];
+    uint32_t histogram[PICOQUIC_SPINOBS_NB_BUCKETS];
+} picoquic_spinobs_flow_t;
+
+typedef struct st_picoquic_spinobs_t picoquic_spinobs_t;
+typedef void (*picoquic_spinobs_flow_end_fn)(picoquic_spinobs_t* obs, const picoquic_spinobs_flow_t* flow, void* flow_end_ctx);
+
+struct st_picoquic_spinobs_t {
+    uint64_t* flow_hash; /* 0 if the slot is free */
+    picoquic_spinobs_flow_t* flows;
+    size_t nb_flows_max; /* Power of 2 */
+    uint64_t hash_seed;
+    uint64_t idle_timeout;
+    picoquic_spinobs_flow_end_fn flow_end_fn;
+    void* flow_end_ctx;
+    unsigned int create_on_short_header : 1;
+    uint64_t nb_datagrams;
+    uint64_t nb_not_quic;
+    uint64_t nb_short_packets;
+    uint64_t nb_samples;
+    uint64_t nb_flows_created;
+    uint64_t nb_flows_evicted;
+    uint64_t nb_flows_expired;
+};
+
+/* The table size is rounded up to a power of 2. */
+int picoquic_spinobs_init(picoquic_spinobs_t* obs, size_t nb_flows_max, uint64_t hash_seed);
+/* Clear frees the table without calling the flow end callback. */
+void picoquic_spinobs_clear(picoquic_spinobs_t* obs);
+void picoquic_spinobs_set_flow_end_callback(picoquic_spinobs_t* obs, picoquic_spinobs_flow_end_fn flow_end_fn, void* flow_end_ctx);
+
+/* Process one observed packet. Returns 0 if the packet was recognized as
+ * QUIC, -1 otherwise. The UDP variant takes the addresses as 4 or 16 bytes
+ * depending on the IP version; the IP variant parses the IPv4 or IPv6 and
+ * UDP headers; the frame variant first skips the link layer header. */
+int picoquic_spinobs_process_udp(picoquic_spinobs_t* obs, uint8_t ip_version,
+    const uint8_t* src_addr, uint16_t src_port, const uint8_t* dst_addr, uint16_t dst_port,
+    const uint8_t* bytes, size_t length, uint64_t current_time);
+int picoquic_spinobs_process_ip(picoquic_spinobs_t* obs, const uint8_t* bytes, size_t length, uint64_t current_time);
+int picoquic_spinobs_process_frame(picoquic_spinobs_t* obs, uint32_t link_type, const uint8_t* bytes, size_t length,
+    uint64_t current_time);
+
+/* Reclaim the flows idle for longer than the idle timeout. */
+void picoquic_spinobs_expire(picoquic_spinobs_t* obs, uint64_t current_time);
+/* Call the flow end callback for all flows and empty the table. */
+void picoquic_spinobs_flush(picoquic_spinobs_t* obs);
+/* Iterate over the active flows. Returns the next flow at or after *index, or NULL. */
+const picoquic_spinobs_flow_t* picoquic_spinobs_next_flow(const picoquic_spinobs_t* obs, size_t* index);
+
+/* Histogram. The bucket i covers the samples from floor(i) to floor(i+1)-1
+ * microseconds; the last bucket is open ended. The percentile is estimated
+ * from the upper bound of the bucket that covers it, clipped to the
+ * observed min and max. */
+int picoquic_spinobs_bucket_index(uint64_t rtt);
+uint64_t picoquic_spinobs_bucket_floor(int bucket_index);
+uint64_t picoquic_spinobs_percentile(const picoquic_spinobs_flow_t* flow, int percent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_SPIN_OBSERVER_H */
@@ -94,6 +94,7 @@ uint64_t picoquic_connection_id_hash(const picoquic_connection_id_t * cid, const
 uint64_t picoquic_val64_connection_id(picoquic_connection_id_t cnx_id);
 size_t picoquic_hash_addr_bytes(const struct sockaddr* addr, uint8_t* bytes);
 uint64_t picoquic_hash_addr(const struct sockaddr* addr, const uint8_t* hash_seed);
+uint64_t picoquic_hash_addr_siphash13(const struct sockaddr* addr, const uint8_t* hash_seed);
 size_t picoquic_parse_hexa(char const* hex_input, size_t input_length, uint8_t* bin_output, size_t output_max);
 uint8_t picoquic_parse_connection_id_hexa(char const * hex_input, size_t input_length, picoquic_connection_id_t * cnx_id);
 int picoquic_print_connection_id_hexa(char* buf, size_t buf_len, const picoquic_connection_id_t* cnxid);
@@ -173,10 +174,8 @@ const uint8_t* picoquic_frames_cid_decode(const uint8_t * bytes, const uint8_t *
 #define VARINT_LEN(bytes) (((uint8_t)1) << ((bytes[0] >> 6)&3))
 #define VARINT_LEN_T(bytes, t_len) (((t_len)1) << ((bytes[0] >> 6)&3))
 
-#if 0
 /* Predict length of a varint encoding */
 size_t picoquic_frames_varint_encode_length(uint64_t n64);
-#endif
 
 /* Encoding functions of the form uint8_t * picoquic_frame_XXX_encode(uint8_t * bytes, uint8_t * bytes-max, ...)
  */
@@ -272,6 +271,38 @@ typedef struct st_picoquictest_sim_packet_t {
     uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
 } picoquictest_sim_packet_t;
 
+/* Pool of packets, so that simulations that send many packets do not
+ * call malloc and free for each of them. If the pool is NULL, the
+ * functions fall back to malloc and free.
+ */
+typedef struct st_picoquictest_sim_packet_pool_t {
+    picoquictest_sim_packet_t* first_free;
+    size_t nb_free;
+    size_t nb_free_max;
+} picoquictest_sim_packet_pool_t;
+
+picoquictest_sim_packet_t* picoquictest_sim_pool_get_packet(picoquictest_sim_packet_pool_t* pool);
+void picoquictest_sim_pool_release_packet(picoquictest_sim_packet_pool_t* pool, picoquictest_sim_packet_t* packet);
+void picoquictest_sim_pool_clear(picoquictest_sim_packet_pool_t* pool);
+
+/* Event scheduler for simulations with many links or nodes.
+ * Each simulated object is allocated a slot, and the scheduler keeps the
+ * slots in a min-heap ordered by wake time. Slots with the same wake time
+ * are ordered by slot number, so the simulation picks the same next event
+ * as when polling the objects one by one in slot order.
+ */
+typedef struct st_picoquictest_sim_sched_t {
+    size_t nb_slots;
+    uint64_t* wake_time;
+    size_t* heap;
+    size_t* heap_position;
+} picoquictest_sim_sched_t;
+
+int picoquictest_sim_sched_init(picoquictest_sim_sched_t* sched, size_t nb_slots);
+void picoquictest_sim_sched_clear(picoquictest_sim_sched_t* sched);
+void picoquictest_sim_sched_update(picoquictest_sim_sched_t* sched, size_t slot, uint64_t wake_time);
+uint64_t picoquictest_sim_sched_next(picoquictest_sim_sched_t* sched, size_t* slot);
+
 typedef enum {
     jitter_gauss = 0,
     jitter_wifi
@@ -314,6 +345,12 @@ typedef struct st_picoquictest_sim_link_t {
     int is_unreachable;
     /* variable for simulating suspension */
     int is_suspended;
+    /* If set, dropped packets are returned to the pool */
+    picoquictest_sim_packet_pool_t* pool;
+    /* If set, the link updates its slot in the scheduler with the arrival time
+     * of the first packet in the queue. */
+    picoquictest_sim_sched_t* sched;
+    size_t sched_slot;
 } picoquictest_sim_link_t;
 
 picoquictest_sim_link_t* picoquictest_sim_link_create(double data_rate_in_gps,
@@ -331,6 +368,9 @@ picoquictest_sim_packet_t* picoquictest_sim_link_dequeue(picoquictest_sim_link_t
 void picoquictest_sim_link_submit(picoquictest_sim_link_t* link, picoquictest_sim_packet_t* packet,
     uint64_t current_time);
 
+void picoquictest_sim_link_set_sched(picoquictest_sim_link_t* link, picoquictest_sim_sched_t* sched, size_t sched_slot);
+void picoquictest_sim_link_sched_refresh(picoquictest_sim_link_t* link);
+
 /* picoquic_test_simlink_suspend simulates and interuption of transmission until the
 * specified "end of interval" time. There are two modes:
 * 
@@ -0,0 +1,187 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoradix.h"
+
+void picoradix_init(picoradix_t* radix)
+{
+    memset(radix, 0, sizeof(picoradix_t));
+}
+
+void picoradix_clear(picoradix_t* radix)
+{
+    if (radix->pages != NULL) {
+        for (size_t i = 0; i < radix->nb_pages; i++) {
+            if (radix->pages[i] != NULL) {
+                free(radix->pages[i]);
+            }
+        }
+        free(radix->pages);
+    }
+    picoradix_init(radix);
+}
+
+void* picoradix_get(const picoradix_t* radix, uint64_t key)
+{
+    void* item = NULL;
+    uint64_t page = key >> PICORADIX_PAGE_BITS;
+
+    if (page >= radix->base_page && page - radix->base_page < radix->nb_pages) {
+        picoradix_page_t* p = radix->pages[page - radix->base_page];
+        if (p != NULL) {
+            item = p->item[key & PICORADIX_PAGE_MASK];
+        }
+    }
+
+    return item;
+}
+
+static int picoradix_reserve(picoradix_t* radix, size_t nb_pages)
+{
+    int ret = 0;
+
+    if (nb_pages > PICORADIX_MAX_PAGES) {
+        ret = -1;
+    }
+    else if (nb_pages > radix->pages_allocated) {
+        size_t new_allocated = (radix->pages_allocated < 4) ? 4 : 2 * radix->pages_allocated;
+        picoradix_page_t** new_pages;
+
+        if (new_allocated < nb_pages) {
+            new_allocated = nb_pages;
+        }
+        if (new_allocated > PICORADIX_MAX_PAGES) {
+            new_allocated = PICORADIX_MAX_PAGES;
+        }
+        new_pages = (picoradix_page_t**)realloc(radix->pages, new_allocated * sizeof(picoradix_page_t*));
+        if (new_pages == NULL) {
+            ret = -1;
+        }
+        else {
+            radix->pages = new_pages;
+            radix->pages_allocated = new_allocated;
+        }
+    }
+
+    return ret;
+}
+
+/* Drop the empty pages at both ends of the window */
+static void picoradix_trim(picoradix_t* radix)
+{
+    size_t nb_leading = 0;
+
+    while (radix->nb_pages > 0 && radix->pages[radix->nb_pages - 1] == NULL) {
+        radix->nb_pages--;
+    }
+    while (nb_leading < radix->nb_pages && radix->pages[nb_leading] == NULL) {
+        nb_leading++;
+    }
+    if (nb_leading > 0) {
+        radix->nb_pages -= nb_leading;
+        memmove(radix->pages, radix->pages + nb_leading, radix->nb_pages * sizeof(picoradix_page_t*));
+        radix->base_page += nb_leading;
+    }
+}
+
+int picoradix_set(picoradix_t* radix, uint64_t key, void* item)
+{
+    int ret = 0;
+    uint64_t page = key >> PICORADIX_PAGE_BITS;
+
+    if (radix->nb_pages == 0) {
+        radix->base_page = page;
+    }
+
+    if (page < radix->base_page) {
+        /* Extend the window towards lower keys */
+        uint64_t delta = radix->base_page - page;
+        if (delta >= PICORADIX_MAX_PAGES || picoradix_reserve(radix, radix->nb_pages + (size_t)delta) != 0) {
+            ret = -1;
+        }
+        else {
+            memmove(radix->pages + delta, radix->pages, radix->nb_pages * sizeof(picoradix_page_t*));
+            memset(radix->pages, 0, (size_t)delta * sizeof(picoradix_page_t*));
+            radix->nb_pages += (size_t)delta;
+            radix->base_page = page;
+        }
+    }
+    else if (page - radix->base_page >= radix->nb_pages) {
+        /* Extend the window towards higher keys */
+        uint64_t nb_pages = page - radix->base_page + 1;
+        if (nb_pages > PICORADIX_MAX_PAGES || picoradix_reserve(radix, (size_t)nb_pages) != 0) {
+            ret = -1;
+        }
+        else {
+            memset(radix->pages + radix->nb_pages, 0, ((size_t)nb_pages - radix->nb_pages) * sizeof(picoradix_page_t*));
+            radix->nb_pages = (size_t)nb_pages;
+        }
+    }
+
+    if (ret == 0) {
+        picoradix_page_t** p = &radix->pages[page - radix->base_page];
+
+        if (*p == NULL) {
+            *p = (picoradix_page_t*)malloc(sizeof(picoradix_page_t));
+            if (*p == NULL) {
+                picoradix_trim(radix);
+                ret = -1;
+            }
+            else {
+                memset(*p, 0, sizeof(picoradix_page_t));
+            }
+        }
+        if (ret == 0) {
+            if ((*p)->item[key & PICORADIX_PAGE_MASK] == NULL) {
+                (*p)->nb_items++;
+                radix->nb_items++;
+            }
+            (*p)->item[key & PICORADIX_PAGE_MASK] = item;
+        }
+    }
+
+    return ret;
+}
+
+void* picoradix_remove(picoradix_t* radix, uint64_t key)
+{
+    void* item = NULL;
+    uint64_t page = key >> PICORADIX_PAGE_BITS;
+
+    if (page >= radix->base_page && page - radix->base_page < radix->nb_pages) {
+        picoradix_page_t** p = &radix->pages[page - radix->base_page];
+
+        if (*p != NULL && (item = (*p)->item[key & PICORADIX_PAGE_MASK]) != NULL) {
+            (*p)->item[key & PICORADIX_PAGE_MASK] = NULL;
+            (*p)->nb_items--;
+            radix->nb_items--;
+            if ((*p)->nb_items == 0) {
+                free(*p);
+                *p = NULL;
+                picoradix_trim(radix);
+            }
+        }
+    }
+
+    return item;
+}
@@ -0,0 +1,77 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Paged radix array.
+*
+* The array maps dense integer keys, such as stream ranks, to item pointers.
+* Keys are split in a page number and an index in the page. The array only
+* holds a window of consecutive pages, starting at "base_page". Pages are
+* allocated when the first item is set, and freed when the last item is
+* removed. When keys progress monotonically, as stream ranks do, empty
+* pages at the beginning of the window are dropped so that the window
+* slides with the keys in use.
+*
+* The window is limited to PICORADIX_MAX_PAGES pages. Setting a key that
+* does not fit in the window fails, and the caller is expected to keep
+* the item in some other structure. Items cannot be NULL, since NULL
+* marks an empty entry.
+*/
+
+#ifndef PICORADIX_H
+#define PICORADIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICORADIX_PAGE_BITS 6
+#define PICORADIX_PAGE_SIZE (1 << PICORADIX_PAGE_BITS)
+#define PICORADIX_PAGE_MASK (PICORADIX_PAGE_SIZE - 1)
+#define PICORADIX_MAX_PAGES 1024
+
+typedef struct st_picoradix_page_t {
+    void* item[PICORADIX_PAGE_SIZE];
+    size_t nb_items;
+} picoradix_page_t;
+
+typedef struct st_picoradix_t {
+    picoradix_page_t** pages;
+    uint64_t base_page;
+    size_t nb_pages; /* Number of pages in the window */
+    size_t pages_allocated; /* Size of the "pages" array */
+    size_t nb_items;
+} picoradix_t;
+
+void picoradix_init(picoradix_t* radix);
+void picoradix_clear(picoradix_t* radix);
+void* picoradix_get(const picoradix_t* radix, uint64_t key);
+int picoradix_set(picoradix_t* radix, uint64_t key, void* item);
+void* picoradix_remove(picoradix_t* radix, uint64_t key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICORADIX_H */
@@ -0,0 +1,417 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Intrusive red-black tree, see picorbtree.h.
+*
+* The implementation follows the classic algorithms, with NULL leaves
+* that are black by convention. Since NULL leaves have no parent pointer,
+* the deletion fix up carries the parent of the current node explicitly.
+*/
+
+#include <stdlib.h>
+#include "picorbtree.h"
+
+#define PICORB_IS_RED(x) ((x) != NULL && (x)->is_red)
+
+static picorb_node_t* picorb_leftmost(picorb_node_t* node)
+{
+    picorb_node_t* parent = NULL;
+    while (node != NULL) {
+        parent = node;
+        node = node->left;
+    }
+    return parent;
+}
+
+static picorb_node_t* picorb_rightmost(picorb_node_t* node)
+{
+    picorb_node_t* parent = NULL;
+    while (node != NULL) {
+        parent = node;
+        node = node->right;
+    }
+    return parent;
+}
+
+/* Replace the subtree at u by the subtree at v in the parent of u */
+static void picorb_transplant(picorb_tree_t* tree, picorb_node_t* u, picorb_node_t* v)
+{
+    if (u->parent == NULL) {
+        tree->root = v;
+    }
+    else if (u == u->parent->left) {
+        u->parent->left = v;
+    }
+    else {
+        u->parent->right = v;
+    }
+    if (v != NULL) {
+        v->parent = u->parent;
+    }
+}
+
+static void picorb_rotate_left(picorb_tree_t* tree, picorb_node_t* x)
+{
+    picorb_node_t* y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL) {
+        y->left->parent = x;
+    }
+    picorb_transplant(tree, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void picorb_rotate_right(picorb_tree_t* tree, picorb_node_t* x)
+{
+    picorb_node_t* y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL) {
+        y->right->parent = x;
+    }
+    picorb_transplant(tree, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+void picorb_init_tree(picorb_tree_t* tree, picorb_comparator comp, picorb_create create, picorb_delete_node delete_node, picorb_node_value node_value)
+{
+    tree->comp = comp;
+    tree->create = create;
+    tree->delete_node = delete_node;
+    tree->node_value = node_value;
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+picorb_tree_t* picorb_new_tree(picorb_comparator comp, picorb_create create, picorb_delete_node delete_node, picorb_node_value node_value)
+{
+    picorb_tree_t* new_tree = (picorb_tree_t*)malloc(sizeof(picorb_tree_t));
+    if (new_tree != NULL) {
+        picorb_init_tree(new_tree, comp, create, delete_node, node_value);
+    }
+    return new_tree;
+}
+
+static void picorb_insert_fixup(picorb_tree_t* tree, picorb_node_t* x)
+{
+    picorb_node_t* p;
+
+    while ((p = x->parent) != NULL && p->is_red) {
+        /* The parent is red, thus not the root, so the grand parent exists */
+        picorb_node_t* g = p->parent;
+
+        if (p == g->left) {
+            picorb_node_t* u = g->right;
+            if (PICORB_IS_RED(u)) {
+                p->is_red = 0;
+                u->is_red = 0;
+                g->is_red = 1;
+                x = g;
+            }
+            else {
+                if (x == p->right) {
+                    picorb_rotate_left(tree, p);
+                    x = p;
+                    p = x->parent;
+                }
+                p->is_red = 0;
+                g->is_red = 1;
+                picorb_rotate_right(tree, g);
+            }
+        }
+        else {
+            picorb_node_t* u = g->left;
+            if (PICORB_IS_RED(u)) {
+                p->is_red = 0;
+                u->is_red = 0;
+                g->is_red = 1;
+                x = g;
+            }
+            else {
+                if (x == p->left) {
+                    picorb_rotate_right(tree, p);
+                    x = p;
+                    p = x->parent;
+                }
+                p->is_red = 0;
+                g->is_red = 1;
+                picorb_rotate_left(tree, g);
+            }
+        }
+    }
+    tree->root->is_red = 0;
+}
+
+picorb_node_t* picorb_insert(picorb_tree_t* tree, void* value)
+{
+    picorb_node_t* new_node = tree->create(value);
+
+    if (new_node != NULL) {
+        picorb_node_t* curr = tree->root;
+        picorb_node_t* parent = NULL;
+        int left = 0;
+
+        while (curr != NULL) {
+            parent = curr;
+            if (tree->comp(value, tree->node_value(curr)) < 0) {
+                left = 1;
+                curr = curr->left;
+            }
+            else {
+                left = 0;
+                curr = curr->right;
+            }
+        }
+        new_node->left = NULL;
+        new_node->right = NULL;
+        new_node->parent = parent;
+        new_node->is_red = 1;
+        if (parent == NULL) {
+            tree->root = new_node;
+        }
+        else if (left) {
+            parent->left = new_node;
+        }
+        else {
+            parent->right = new_node;
+        }
+        picorb_insert_fixup(tree, new_node);
+        tree->size++;
+    }
+
+    return new_node;
+}
+
+/* Find the first node with the given value. The tree is not modified. */
+picorb_node_t* picorb_find(picorb_tree_t* tree, void* value)
+{
+    picorb_node_t* curr = tree->root;
+    picorb_node_t* found = NULL;
+
+    while (curr != NULL) {
+        int64_t relation = tree->comp(value, tree->node_value(curr));
+        if (relation <= 0) {
+            if (relation == 0) {
+                found = curr;
+            }
+            curr = curr->left;
+        }
+        else {
+            curr = curr->right;
+        }
+    }
+
+    return found;
+}
+
+/* Find the last node with a value lower than or equal to the given one */
+picorb_node_t* picorb_find_previous(picorb_tree_t* tree, void* value)
+{
+    picorb_node_t* curr = tree->root;
+    picorb_node_t* previous = NULL;
+
+    while (curr != NULL) {
+        if (tree->comp(value, tree->node_value(curr)) < 0) {
+            curr = curr->left;
+        }
+        else {
+            previous = curr;
+            curr = curr->right;
+        }
+    }
+
+    return previous;
+}
+
+picorb_node_t* picorb_first(picorb_tree_t* tree)
+{
+    return picorb_leftmost(tree->root);
+}
+
+picorb_node_t* picorb_last(picorb_tree_t* tree)
+{
+    return picorb_rightmost(tree->root);
+}
+
+picorb_node_t* picorb_previous(picorb_node_t* node)
+{
+    if (node->left != NULL) {
+        return picorb_rightmost(node->left);
+    }
+    while (node->parent != NULL && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+picorb_node_t* picorb_next(picorb_node_t* node)
+{
+    if (node->right != NULL) {
+        return picorb_leftmost(node->right);
+    }
+    while (node->parent != NULL && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/* Restore the black height after removing a black node. The node x, possibly
+ * NULL, is "doubly black", and parent is its parent. */
+static void picorb_delete_fixup(picorb_tree_t* tree, picorb_node_t* x, picorb_node_t* parent)
+{
+    while (x != tree->root && !PICORB_IS_RED(x) && parent != NULL) {
+        if (x == parent->left) {
+            picorb_node_t* w = parent->right;
+            if (w == NULL) {
+                /* Cannot happen in a valid tree */
+                break;
+            }
+            if (w->is_red) {
+                w->is_red = 0;
+                parent->is_red = 1;
+                picorb_rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if (!PICORB_IS_RED(w->left) && !PICORB_IS_RED(w->right)) {
+                w->is_red = 1;
+                x = parent;
+                parent = x->parent;
+            }
+            else {
+                if (!PICORB_IS_RED(w->right)) {
+                    w->left->is_red = 0;
+                    w->is_red = 1;
+                    picorb_rotate_right(tree, w);
+                    w = parent->right;
+                }
+                w->is_red = parent->is_red;
+                parent->is_red = 0;
+                if (w->right != NULL) {
+                    w->right->is_red = 0;
+                }
+                picorb_rotate_left(tree, parent);
+                x = tree->root;
+                parent = NULL;
+            }
+        }
+        else {
+            picorb_node_t* w = parent->left;
+            if (w == NULL) {
+                break;
+            }
+            if (w->is_red) {
+                w->is_red = 0;
+                parent->is_red = 1;
+                picorb_rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if (!PICORB_IS_RED(w->left) && !PICORB_IS_RED(w->right)) {
+                w->is_red = 1;
+                x = parent;
+                parent = x->parent;
+            }
+            else {
+                if (!PICORB_IS_RED(w->left)) {
+                    w->right->is_red = 0;
+                    w->is_red = 1;
+                    picorb_rotate_left(tree, w);
+                    w = parent->left;
+                }
+                w->is_red = parent->is_red;
+                parent->is_red = 0;
+                if (w->left != NULL) {
+                    w->left->is_red = 0;
+                }
+                picorb_rotate_right(tree, parent);
+                x = tree->root;
+                parent = NULL;
+            }
+        }
+    }
+    if (x != NULL) {
+        x->is_red = 0;
+    }
+}
+
+/* Remove the node given by the pointer, and delete it. */
+void picorb_delete_hint(picorb_tree_t* tree, picorb_node_t* node)
+{
+    picorb_node_t* child;
+    picorb_node_t* parent;
+    int removed_red;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->left == NULL || node->right == NULL) {
+        child = (node->left != NULL) ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->is_red;
+        picorb_transplant(tree, node, child);
+    }
+    else {
+        /* Replace the node by its successor, which has no left child */
+        picorb_node_t* y = picorb_leftmost(node->right);
+
+        removed_red = y->is_red;
+        child = y->right;
+        if (y->parent == node) {
+            parent = y;
+        }
+        else {
+            parent = y->parent;
+            picorb_transplant(tree, y, child);
+            y->right = node->right;
+            y->right->parent = y;
+        }
+        picorb_transplant(tree, node, y);
+        y->left = node->left;
+        y->left->parent = y;
+        y->is_red = node->is_red;
+    }
+
+    if (!removed_red) {
+        picorb_delete_fixup(tree, child, parent);
+    }
+
+    tree->delete_node(tree, node);
+    tree->size--;
+}
+
+void picorb_delete(picorb_tree_t* tree, void* value)
+{
+    picorb_delete_hint(tree, picorb_find(tree, value));
+}
+
+void picorb_empty_tree(picorb_tree_t* tree)
+{
+    if (tree != NULL) {
+        while (tree->root != NULL) {
+            picorb_delete_hint(tree, tree->root);
+        }
+    }
+}
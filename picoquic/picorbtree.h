@@ -0,0 +1,84 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Intrusive red-black tree.
+*
+* The API mirrors that of picosplay: the node is embedded in the object,
+* and the tree is parameterized by the same comparator, create, delete and
+* node value callbacks, so a user of picosplay can switch by changing the
+* types and the function prefix. Unlike the splay tree, lookups do not
+* modify the tree, which is balanced at all times: the cost of a lookup is
+* bounded by 2*log2(size), at the price of slightly more work on insertion
+* and deletion and one more field per node. This is the better choice for
+* trees that are mostly searched, or searched in random order. The splay
+* tree remains better when the same few nodes are accessed repeatedly,
+* or when nodes are mostly added at one end and removed at the other.
+* Nodes that compare equal are kept in insertion order.
+*/
+
+#ifndef PICORBTREE_H
+#define PICORBTREE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct st_picorb_node_t {
+    struct st_picorb_node_t *parent, *left, *right;
+    int is_red;
+} picorb_node_t;
+
+typedef int64_t(*picorb_comparator)(void *left, void *right);
+typedef picorb_node_t * (*picorb_create)(void * value);
+typedef void(*picorb_delete_node)(void * tree, picorb_node_t * node);
+typedef void* (*picorb_node_value)(picorb_node_t * node);
+
+typedef struct st_picorb_tree_t {
+    picorb_node_t *root;
+    picorb_comparator comp;
+    picorb_create create;
+    picorb_delete_node delete_node;
+    picorb_node_value node_value;
+    int size;
+} picorb_tree_t;
+
+void picorb_init_tree(picorb_tree_t* tree, picorb_comparator comp, picorb_create create, picorb_delete_node delete_node, picorb_node_value node_value);
+picorb_tree_t* picorb_new_tree(picorb_comparator comp, picorb_create create, picorb_delete_node delete_node, picorb_node_value node_value);
+picorb_node_t* picorb_insert(picorb_tree_t *tree, void *value);
+picorb_node_t* picorb_find(picorb_tree_t *tree, void *value);
+picorb_node_t* picorb_find_previous(picorb_tree_t* tree, void* value);
+picorb_node_t* picorb_first(picorb_tree_t *tree);
+picorb_node_t* picorb_previous(picorb_node_t* node);
+picorb_node_t* picorb_next(picorb_node_t *node);
+picorb_node_t* picorb_last(picorb_tree_t *tree);
+void picorb_delete(picorb_tree_t *tree, void *value);
+void picorb_delete_hint(picorb_tree_t *tree, picorb_node_t *node);
+void picorb_empty_tree(picorb_tree_t *tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICORBTREE_H */
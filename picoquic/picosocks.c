@@ -21,6 +21,7 @@
 
 #include "picosocks.h"
 #include "picoquic_utils.h"
+#include "picoquic_probes.h"
 
 int picoquic_bind_to_port(SOCKET_TYPE fd, int af, int port)
 {
@@ -334,6 +335,17 @@ void picoquic_socks_cmsg_parse(
     int* dest_if,
     unsigned char* received_ecn,
     size_t * udp_coalesced_size)
+{
+    picoquic_socks_cmsg_parse_ex(vmsg, addr_dest, dest_if, received_ecn, udp_coalesced_size, NULL);
+}
+
+void picoquic_socks_cmsg_parse_ex(
+    void* vmsg,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    size_t * udp_coalesced_size,
+    uint64_t * receive_time)
 {
     /* Assume that msg has been filled by a call to recvmsg */
 #if _WINDOWS
@@ -413,6 +425,9 @@ void picoquic_socks_cmsg_parse(
             DBG_PRINTF("Cmsg level: %d, type: %d\n", cmsg->cmsg_level, cmsg->cmsg_type);
         }
     }
+#ifdef UNREFERENCED_PARAMETER
+    UNREFERENCED_PARAMETER(receive_time);
+#endif
 #else
     /* Get the control information */
     struct msghdr* msg = (struct msghdr*)vmsg;
@@ -478,8 +493,54 @@ void picoquic_socks_cmsg_parse(
                 }
             }
         }
+#if defined(UDP_GRO)
+        else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            /* Size of the segments coalesced by UDP GRO */
+            if (cmsg->cmsg_len > 0 && udp_coalesced_size != NULL) {
+                int gro_size;
+                memcpy(&gro_size, CMSG_DATA(cmsg), sizeof(int));
+                *udp_coalesced_size = (gro_size > 0) ? (size_t)gro_size : 0;
+            }
+        }
+#endif
+        else if (cmsg->cmsg_level == SOL_SOCKET && receive_time != NULL) {
+            /* Kernel receive timestamps, in the same clock as picoquic_current_time() */
+#if defined(SCM_TIMESTAMPING)
+            if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                /* Three timestamps: software, deprecated, raw hardware. Only the
+                 * software one is expressed in the system clock. */
+                struct timespec ts[3];
+                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                if (ts[0].tv_sec != 0 || ts[0].tv_nsec != 0) {
+                    *receive_time = ((uint64_t)ts[0].tv_sec) * 1000000 + ((uint64_t)ts[0].tv_nsec) / 1000;
+                }
+            }
+            else
+#endif
+#if defined(SCM_TIMESTAMPNS)
+            if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                *receive_time = ((uint64_t)ts.tv_sec) * 1000000 + ((uint64_t)ts.tv_nsec) / 1000;
+            }
+            else
+#endif
+#if defined(SCM_TIMESTAMP)
+            if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+                struct timeval tv;
+                memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+                *receive_time = ((uint64_t)tv.tv_sec) * 1000000 + (uint64_t)tv.tv_usec;
+            }
+            else
+#endif
+            {
+                DBG_PRINTF("Cmsg level: %d, type: %d\n", cmsg->cmsg_level, cmsg->cmsg_type);
+            }
+        }
     }
 #endif
+    PICOQUIC_PROBE3(socks_cmsg_parse, (received_ecn == NULL) ? 0 : *received_ecn,
+        (udp_coalesced_size == NULL) ? 0 : *udp_coalesced_size, (receive_time == NULL) ? 0 : *receive_time);
 }
 
 #ifdef _WINDOWS
@@ -535,6 +596,17 @@ void picoquic_socks_cmsg_format(
     size_t send_msg_size,
     struct sockaddr* addr_from,
     int dest_if)
+{
+    picoquic_socks_cmsg_format_ex(vmsg, message_length, send_msg_size, addr_from, dest_if, 0);
+}
+
+void picoquic_socks_cmsg_format_ex(
+    void* vmsg,
+    size_t message_length,
+    size_t send_msg_size,
+    struct sockaddr* addr_from,
+    int dest_if,
+    uint64_t txtime_ns)
 {
 #ifdef _WINDOWS
     WSAMSG* msg = (WSAMSG*)vmsg;
@@ -619,6 +691,9 @@ void picoquic_socks_cmsg_format(
             *pdw = (DWORD)send_msg_size;
         }
     }
+#ifdef UNREFERENCED_PARAMETER
+    UNREFERENCED_PARAMETER(txtime_ns);
+#endif
 
     msg->Control.len = control_length;
     if (control_length == 0) {
@@ -712,6 +787,22 @@ void picoquic_socks_cmsg_format(
         }
     }
 #endif
+#if defined(SCM_TXTIME)
+    /* Departure time, only honored if SO_TXTIME is set on the socket and
+     * the egress qdisc (typically fq) supports earliest departure time. */
+    if (!is_null && txtime_ns != 0) {
+        uint8_t* pval = (uint8_t*)cmsg_format_header_return_data_ptr(msg, &last_cmsg,
+            &control_length, SOL_SOCKET, SCM_TXTIME, sizeof(uint64_t));
+        if (pval != NULL) {
+            memcpy(pval, &txtime_ns, sizeof(uint64_t));
+        }
+        else {
+            is_null = 1;
+        }
+    }
+#else
+    (void)txtime_ns;
+#endif
 
     msg->msg_controllen = control_length;
     if (control_length == 0) {
@@ -799,7 +890,7 @@ picoquic_recvmsg_async_ctx_t * picoquic_create_async_socket(int af, int recv_coa
 #ifdef UDP_RECV_MAX_COALESCED_SIZE
                 if (ret == 0) {
                     DWORD coalesced_size = 0x10000;
-                    ctx->recv_buffer_size = (recv_coalesced)?coalesced_size:PICOQUIC_MAX_PACKET_SIZE;
+                    ctx->recv_buffer_size = (recv_coalesced)?coalesced_size:PICOQUIC_MAX_JUMBO_PACKET_SIZE;
                     ctx->recv_buffer = (uint8_t*)malloc(ctx->recv_buffer_size);
                     ctx->supports_udp_recv_coalesced = recv_coalesced;
                     ctx->supports_udp_send_coalesced = send_coalesced;
@@ -821,7 +912,7 @@ picoquic_recvmsg_async_ctx_t * picoquic_create_async_socket(int af, int recv_coa
                 }
 #else
                 if (ret == 0) {
-                    ctx->recv_buffer_size = PICOQUIC_MAX_PACKET_SIZE;
+                    ctx->recv_buffer_size = PICOQUIC_MAX_JUMBO_PACKET_SIZE;
                     ctx->recv_buffer = (uint8_t*)malloc(ctx->recv_buffer_size);
                     ctx->supports_udp_recv_coalesced = 0;
                     ctx->supports_udp_send_coalesced = 0;
@@ -1003,6 +1094,17 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
     return bytes_recv;
 }
 #else
+{
+    return picoquic_recvmsg_ex(fd, addr_from, addr_dest, dest_if, received_ecn, buffer, buffer_max, 0, NULL, NULL);
+}
+
+int picoquic_recvmsg_ex(SOCKET_TYPE fd,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max, int flags,
+    size_t* udp_coalesced_size, uint64_t* receive_time)
 {
     int bytes_recv = 0;
     struct msghdr msg;
@@ -1024,12 +1126,19 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
     msg.msg_control = (void*)cmsg_buffer;
     msg.msg_controllen = sizeof(cmsg_buffer);
 
-    bytes_recv = recvmsg(fd, &msg, 0);
+    if (udp_coalesced_size != NULL) {
+        *udp_coalesced_size = 0;
+    }
+    if (receive_time != NULL) {
+        *receive_time = 0;
+    }
+
+    bytes_recv = recvmsg(fd, &msg, flags);
 
     if (bytes_recv <= 0) {
         addr_from->ss_family = 0;
     } else {
-        picoquic_socks_cmsg_parse(&msg, addr_dest, dest_if, received_ecn, NULL);
+        picoquic_socks_cmsg_parse_ex(&msg, addr_dest, dest_if, received_ecn, udp_coalesced_size, receive_time);
     }
 
     return bytes_recv;
@@ -1109,6 +1218,19 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
     return bytes_sent;
 }
 #else
+{
+    return picoquic_sendmsg_ex(fd, addr_dest, addr_from, dest_if, bytes, length, send_msg_size, 0, 0, sock_err);
+}
+
+int picoquic_sendmsg_ex(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size,
+    uint64_t txtime_ns,
+    int flags,
+    int * sock_err)
 {
     struct msghdr msg;
     struct iovec dataBuf;
@@ -1129,9 +1251,9 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
     msg.msg_controllen = sizeof(cmsg_buffer);
 
     /* Format the control message */
-    picoquic_socks_cmsg_format(&msg, length, send_msg_size, addr_from, dest_if);
+    picoquic_socks_cmsg_format_ex(&msg, length, send_msg_size, addr_from, dest_if, txtime_ns);
 
-    bytes_sent = sendmsg(fd, &msg, 0);
+    bytes_sent = sendmsg(fd, &msg, flags);
 
 
     if (bytes_sent <= 0) {
@@ -1338,6 +1460,79 @@ int picoquic_get_server_address(const char* ip_address_text, int server_port,
     return ret;
 }
 
+int picoquic_get_server_addresses(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_address_v6, struct sockaddr_storage* server_address_v4,
+    int* is_name)
+{
+    int ret = 0;
+    struct sockaddr_in* ipv4_dest = (struct sockaddr_in*)server_address_v4;
+    struct sockaddr_in6* ipv6_dest = (struct sockaddr_in6*)server_address_v6;
+
+    memset(server_address_v6, 0, sizeof(struct sockaddr_storage));
+    memset(server_address_v4, 0, sizeof(struct sockaddr_storage));
+    *is_name = 0;
+
+    if (inet_pton(AF_INET, ip_address_text, &ipv4_dest->sin_addr) == 1) {
+        ipv4_dest->sin_family = AF_INET;
+        ipv4_dest->sin_port = htons((unsigned short)server_port);
+    }
+    else if (inet_pton(AF_INET6, ip_address_text, &ipv6_dest->sin6_addr) == 1) {
+        ipv6_dest->sin6_family = AF_INET6;
+        ipv6_dest->sin6_port = htons((unsigned short)server_port);
+    }
+    else {
+        /* Keep the first address of each family, in the order of preference
+         * returned by the resolver. */
+        struct addrinfo* result = NULL;
+        struct addrinfo hints;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+
+        if ((ret = getaddrinfo(ip_address_text, NULL, &hints, &result)) != 0) {
+#ifdef _WINDOWS
+            int err = GetLastError();
+#else
+            int err = ret;
+#endif
+            fprintf(stderr, "Cannot get IP address for %s, err = %d (0x%x)\n", ip_address_text, err, err);
+            ret = -1;
+        }
+        else {
+            struct addrinfo* next = result;
+
+            *is_name = 1;
+
+            while (next != NULL) {
+                if (next->ai_family == AF_INET && ipv4_dest->sin_family == 0) {
+                    memcpy(&ipv4_dest->sin_addr, &((struct sockaddr_in*)next->ai_addr)->sin_addr,
+                        sizeof(ipv4_dest->sin_addr));
+                    ipv4_dest->sin_family = AF_INET;
+                    ipv4_dest->sin_port = htons((unsigned short)server_port);
+                }
+                else if (next->ai_family == AF_INET6 && ipv6_dest->sin6_family == 0) {
+                    memcpy(&ipv6_dest->sin6_addr, &((struct sockaddr_in6*)next->ai_addr)->sin6_addr,
+                        sizeof(ipv6_dest->sin6_addr));
+                    ipv6_dest->sin6_family = AF_INET6;
+                    ipv6_dest->sin6_port = htons((unsigned short)server_port);
+                }
+                next = next->ai_next;
+            }
+
+            freeaddrinfo(result);
+
+            if (ipv4_dest->sin_family == 0 && ipv6_dest->sin6_family == 0) {
+                fprintf(stderr, "No IPv4 or IPv6 address for %s\n", ip_address_text);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
 /* Wireshark needs the session keys in order to decrypt and analyze packets.
  * In Unix and Windows, Wireshark reads these keys from a file. The name
  * of the file is passed in the environment variable SSLKEYLOGFILE,
@@ -213,6 +213,22 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
     unsigned char* received_ecn,
     uint8_t* buffer, int buffer_max);
 
+#ifndef _WINDOWS
+/* Same as picoquic_recvmsg, passing the specified flags to recvmsg,
+ * e.g., MSG_DONTWAIT when reading non-blocking from a blocking socket.
+ * If udp_coalesced_size is not NULL, it is set to the segment size
+ * reported by UDP GRO, or 0 if the buffer holds a single datagram.
+ * If receive_time is not NULL, it is set to the kernel receive timestamp
+ * in microseconds, or 0 if the socket does not report timestamps. */
+int picoquic_recvmsg_ex(SOCKET_TYPE fd,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max, int flags,
+    size_t* udp_coalesced_size, uint64_t* receive_time);
+#endif
+
 int picoquic_sendmsg(SOCKET_TYPE fd,
     struct sockaddr* addr_dest,
     struct sockaddr* addr_from,
@@ -220,6 +236,19 @@ int picoquic_sendmsg(SOCKET_TYPE fd,
     const char* bytes, int length,
     int send_msg_size, int * sock_err);
 
+#ifndef _WINDOWS
+/* Same as picoquic_sendmsg, but if txtime_ns is not zero, attach an
+ * SCM_TXTIME departure time, expressed in CLOCK_MONOTONIC nanoseconds.
+ * This requires setting SO_TXTIME on the socket. The flags are passed
+ * to sendmsg, e.g., MSG_ZEROCOPY. */
+int picoquic_sendmsg_ex(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size, uint64_t txtime_ns, int flags, int * sock_err);
+#endif
+
 int picoquic_send_through_socket(
     SOCKET_TYPE fd,
     struct sockaddr* addr_dest,
@@ -236,6 +265,13 @@ int picoquic_get_server_address(const char* ip_address_text, int server_port,
     struct sockaddr_storage* server_address,
     int* is_name);
 
+/* Resolve one IPv6 and one IPv4 address for the server, for use with
+ * picoquic_create_racing_cnx. The family of an address that cannot be found
+ * is left at zero. Returns -1 if neither address is found. */
+int picoquic_get_server_addresses(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_address_v6, struct sockaddr_storage* server_address_v4,
+    int* is_name);
+
 /* Wireshark needs the session keys in order to decrypt and analyze packets.
  * In Unix and Windows, Wireshark reads these keys from a file. The name
  * of the file is passed in the environment variable SSLKEYLOGFILE,
@@ -258,6 +294,18 @@ void picoquic_socks_cmsg_parse(
     unsigned char* received_ecn,
     size_t* udp_coalesced_size);
 
+/* Same as picoquic_socks_cmsg_parse, but if receive_time is not NULL,
+ * set it to the receive timestamp found in the control data, if any.
+ * The timestamps are requested with SO_TIMESTAMPING, SO_TIMESTAMPNS or
+ * SO_TIMESTAMP, and converted to microseconds since the epoch. */
+void picoquic_socks_cmsg_parse_ex(
+    void* vmsg,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    size_t* udp_coalesced_size,
+    uint64_t* receive_time);
+
 void picoquic_socks_cmsg_format(
     void* vmsg,
     size_t message_length,
@@ -265,6 +313,14 @@ void picoquic_socks_cmsg_format(
     struct sockaddr* addr_from,
     int dest_if);
 
+void picoquic_socks_cmsg_format_ex(
+    void* vmsg,
+    size_t message_length,
+    size_t send_msg_size,
+    struct sockaddr* addr_from,
+    int dest_if,
+    uint64_t txtime_ns);
+
 #ifdef __cplusplus
 }
 #endif
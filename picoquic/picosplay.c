@@ -161,7 +161,26 @@ picosplay_node_t* picosplay_find(picosplay_tree_t *tree, void *value)
     return curr;
 }
 
-/* Find a node with the given value, splaying the tree. */
+/* Find a node with the given value, without splaying the tree. */
+picosplay_node_t* picosplay_lookup(picosplay_tree_t *tree, void *value)
+{
+    picosplay_node_t *curr = tree->root;
+
+    while (curr != NULL) {
+        int64_t relation = tree->comp(value, tree->node_value(curr));
+        if (relation == 0) {
+            break;
+        } else if (relation < 0) {
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
+    }
+
+    return curr;
+}
+
+/* Find the last node with a value lower than or equal to the given one, without splaying the tree. */
 picosplay_node_t* picosplay_find_previous(picosplay_tree_t* tree, void* value)
 {
     picosplay_node_t* curr = tree->root;
@@ -54,6 +54,12 @@ void picosplay_init_tree(picosplay_tree_t* tree, picosplay_comparator comp, pico
 picosplay_tree_t* picosplay_new_tree(picosplay_comparator comp, picosplay_create create, picosplay_delete_node delete_node, picosplay_node_value node_value);
 picosplay_node_t* picosplay_insert(picosplay_tree_t *tree, void *value);
 picosplay_node_t* picosplay_find(picosplay_tree_t *tree, void *value);
+/* Same as picosplay_find, but does not splay the tree, so the nodes on the
+ * search path are not written. Beware that the splay tree is only balanced
+ * on average by the splaying: after insertions in key order, it is a list,
+ * and lookups without splay cost a full walk. Trees that are mostly
+ * searched are better served by picorbtree.h. */
+picosplay_node_t* picosplay_lookup(picosplay_tree_t *tree, void *value);
 picosplay_node_t* picosplay_find_previous(picosplay_tree_t* tree, void* value);
 picosplay_node_t* picosplay_first(picosplay_tree_t *tree);
 picosplay_node_t* picosplay_previous(picosplay_node_t* node);
@@ -0,0 +1,314 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picowheel.h"
+
+/* Index of the lowest bit set in a non zero 64 bit value */
+static int picowheel_lowest_bit(uint64_t x)
+{
+    int rank = 0;
+
+    if ((x & 0xFFFFFFFFull) == 0) {
+        rank += 32;
+        x >>= 32;
+    }
+    if ((x & 0xFFFFull) == 0) {
+        rank += 16;
+        x >>= 16;
+    }
+    if ((x & 0xFFull) == 0) {
+        rank += 8;
+        x >>= 8;
+    }
+    if ((x & 0xFull) == 0) {
+        rank += 4;
+        x >>= 4;
+    }
+    if ((x & 0x3ull) == 0) {
+        rank += 2;
+        x >>= 2;
+    }
+    if ((x & 0x1ull) == 0) {
+        rank += 1;
+    }
+    return rank;
+}
+
+/* Index of the first non empty slot at or after "from" in a level, or -1 */
+static int picowheel_next_slot(picowheel_t* wheel, int level, int from)
+{
+    int word = from / 64;
+
+    if (from < PICOWHEEL_NB_SLOTS) {
+        uint64_t bits = wheel->bitmap[level][word] & (UINT64_MAX << (from % 64));
+
+        while (bits == 0) {
+            word++;
+            if (word >= PICOWHEEL_NB_SLOTS / 64) {
+                return -1;
+            }
+            bits = wheel->bitmap[level][word];
+        }
+        return word * 64 + picowheel_lowest_bit(bits);
+    }
+    return -1;
+}
+
+static void picowheel_list_append(picowheel_list_t* list, picowheel_node_t* node)
+{
+    node->next = NULL;
+    node->previous = list->last;
+    if (list->last == NULL) {
+        list->first = node;
+    }
+    else {
+        list->last->next = node;
+    }
+    list->last = node;
+}
+
+static void picowheel_list_unlink(picowheel_list_t* list, picowheel_node_t* node)
+{
+    if (node->previous == NULL) {
+        list->first = node->next;
+    }
+    else {
+        node->previous->next = node->next;
+    }
+    if (node->next == NULL) {
+        list->last = node->previous;
+    }
+    else {
+        node->next->previous = node->previous;
+    }
+    node->next = NULL;
+    node->previous = NULL;
+}
+
+/* The overdue list is kept sorted by wake time. Nodes are mostly moved there
+ * in ascending order, so the search from the tail is short. Equal times
+ * keep their insertion order.
+ */
+static void picowheel_overdue_insert(picowheel_t* wheel, picowheel_node_t* node)
+{
+    picowheel_node_t* previous = wheel->overdue.last;
+
+    while (previous != NULL && previous->wake_time > node->wake_time) {
+        previous = previous->previous;
+    }
+    node->level = PICOWHEEL_LEVEL_OVERDUE;
+    node->slot = 0;
+    if (previous == NULL) {
+        node->previous = NULL;
+        node->next = wheel->overdue.first;
+        if (wheel->overdue.first == NULL) {
+            wheel->overdue.last = node;
+        }
+        else {
+            wheel->overdue.first->previous = node;
+        }
+        wheel->overdue.first = node;
+    }
+    else if (previous->next == NULL) {
+        picowheel_list_append(&wheel->overdue, node);
+    }
+    else {
+        node->previous = previous;
+        node->next = previous->next;
+        previous->next->previous = node;
+        previous->next = node;
+    }
+}
+
+/* Place a node in the wheel, relative to the current wheel time */
+static void picowheel_place(picowheel_t* wheel, picowheel_node_t* node)
+{
+    if (node->wake_time < wheel->wheel_time) {
+        picowheel_overdue_insert(wheel, node);
+    }
+    else {
+        uint64_t delta = node->wake_time ^ wheel->wheel_time;
+        int level = 0;
+        int slot;
+
+        while (level < PICOWHEEL_NB_LEVELS - 1 && (delta >> (8 * (level + 1))) != 0) {
+            level++;
+        }
+        slot = (int)((node->wake_time >> (8 * level)) & 0xFF);
+        node->level = (uint8_t)level;
+        node->slot = (uint8_t)slot;
+        picowheel_list_append(&wheel->slots[level][slot], node);
+        wheel->bitmap[level][slot / 64] |= (1ull << (slot % 64));
+
+        if (wheel->min_cache != NULL && wheel->min_cache->level == level &&
+            wheel->min_cache->slot == slot && node->wake_time < wheel->min_cache->wake_time) {
+            wheel->min_cache = node;
+        }
+    }
+}
+
+void picowheel_init(picowheel_t* wheel, uint64_t start_time)
+{
+    memset(wheel, 0, sizeof(picowheel_t));
+    wheel->wheel_time = start_time;
+}
+
+picowheel_t* picowheel_new(uint64_t start_time)
+{
+    picowheel_t* wheel = (picowheel_t*)malloc(sizeof(picowheel_t));
+
+    if (wheel != NULL) {
+        picowheel_init(wheel, start_time);
+    }
+    return wheel;
+}
+
+/* Nodes are owned by the caller, and must be removed before the wheel is deleted. */
+void picowheel_delete(picowheel_t* wheel)
+{
+    free(wheel);
+}
+
+void picowheel_insert(picowheel_t* wheel, picowheel_node_t* node, uint64_t wake_time)
+{
+    if (node->is_inserted) {
+        picowheel_remove(wheel, node);
+    }
+    node->wake_time = wake_time;
+    node->is_inserted = 1;
+    picowheel_place(wheel, node);
+    wheel->size++;
+}
+
+void picowheel_remove(picowheel_t* wheel, picowheel_node_t* node)
+{
+    if (node->is_inserted) {
+        if (node->level == PICOWHEEL_LEVEL_OVERDUE) {
+            picowheel_list_unlink(&wheel->overdue, node);
+        }
+        else {
+            picowheel_list_t* list = &wheel->slots[node->level][node->slot];
+            picowheel_list_unlink(list, node);
+            if (list->first == NULL) {
+                wheel->bitmap[node->level][node->slot / 64] &= ~(1ull << (node->slot % 64));
+            }
+        }
+        if (wheel->min_cache == node) {
+            wheel->min_cache = NULL;
+        }
+        node->is_inserted = 0;
+        wheel->size--;
+    }
+}
+
+/* All overdue nodes are earlier than the wheel time, and all nodes at a
+ * given level are earlier than the nodes at higher levels. Nodes in a level 0
+ * slot all have the same wake time; slots at higher levels must be scanned.
+ */
+picowheel_node_t* picowheel_first(picowheel_t* wheel)
+{
+    picowheel_node_t* first = wheel->overdue.first;
+
+    if (first == NULL && wheel->size > 0) {
+        for (int level = 0; level < PICOWHEEL_NB_LEVELS; level++) {
+            int slot = picowheel_next_slot(wheel, level, 0);
+            if (slot >= 0) {
+                first = wheel->slots[level][slot].first;
+                if (level > 0) {
+                    if (wheel->min_cache != NULL && wheel->min_cache->level == level &&
+                        wheel->min_cache->slot == slot) {
+                        first = wheel->min_cache;
+                    }
+                    else {
+                        picowheel_node_t* next = first->next;
+                        while (next != NULL) {
+                            if (next->wake_time < first->wake_time) {
+                                first = next;
+                            }
+                            next = next->next;
+                        }
+                        wheel->min_cache = first;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return first;
+}
+
+/* Move the wheel time forward. Nodes that become due are moved to the
+ * overdue list, and the nodes in the slot covering the new time are
+ * redistributed to the lower levels.
+ */
+void picowheel_advance(picowheel_t* wheel, uint64_t current_time)
+{
+    if (current_time > wheel->wheel_time) {
+        uint64_t delta = current_time ^ wheel->wheel_time;
+        int high = 0;
+        int from;
+        int to;
+        picowheel_list_t cascade;
+
+        while (high < PICOWHEEL_NB_LEVELS - 1 && (delta >> (8 * (high + 1))) != 0) {
+            high++;
+        }
+        wheel->min_cache = NULL;
+        /* Everything below the highest changed level is now due */
+        for (int level = 0; level < high; level++) {
+            int slot = picowheel_next_slot(wheel, level, 0);
+            while (slot >= 0) {
+                picowheel_node_t* node;
+                while ((node = wheel->slots[level][slot].first) != NULL) {
+                    picowheel_list_unlink(&wheel->slots[level][slot], node);
+                    picowheel_overdue_insert(wheel, node);
+                }
+                wheel->bitmap[level][slot / 64] &= ~(1ull << (slot % 64));
+                slot = picowheel_next_slot(wheel, level, slot + 1);
+            }
+        }
+        /* At the highest changed level, so are the slots passed over */
+        from = (int)((wheel->wheel_time >> (8 * high)) & 0xFF);
+        to = (int)((current_time >> (8 * high)) & 0xFF);
+        for (int slot = picowheel_next_slot(wheel, high, from); slot >= 0 && slot < to;
+            slot = picowheel_next_slot(wheel, high, slot + 1)) {
+            picowheel_node_t* node;
+            while ((node = wheel->slots[high][slot].first) != NULL) {
+                picowheel_list_unlink(&wheel->slots[high][slot], node);
+                picowheel_overdue_insert(wheel, node);
+            }
+            wheel->bitmap[high][slot / 64] &= ~(1ull << (slot % 64));
+        }
+        /* The slot containing the new time is redistributed */
+        wheel->wheel_time = current_time;
+        cascade = wheel->slots[high][to];
+        wheel->slots[high][to].first = NULL;
+        wheel->slots[high][to].last = NULL;
+        wheel->bitmap[high][to / 64] &= ~(1ull << (to % 64));
+        while (cascade.first != NULL) {
+            picowheel_node_t* node = cascade.first;
+            picowheel_list_unlink(&cascade, node);
+            picowheel_place(wheel, node);
+        }
+    }
+}
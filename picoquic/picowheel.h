@@ -0,0 +1,88 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Hierarchical timer wheel.
+*
+* The wheel keeps a set of nodes sorted by wake time, in microseconds. It
+* uses 8 levels of 256 slots, one level per byte of the 64 bit time. Level 0
+* slots are one microsecond wide, level 1 slots 256 microseconds, level 2
+* slots 65 milliseconds, etc. A node is placed at the level of the highest
+* byte in which its wake time differs from the current wheel time, so that
+* insertion, deletion and retrieval of the earliest node are O(1) in the
+* common case. Nodes that are already due are kept in a separate "overdue"
+* list, sorted by wake time.
+*
+* Nodes are embedded in the structures that they represent, as done for
+* the splay trees. The wheel never allocates or frees nodes.
+*/
+
+#ifndef PICOWHEEL_H
+#define PICOWHEEL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICOWHEEL_NB_LEVELS 8
+#define PICOWHEEL_NB_SLOTS 256
+#define PICOWHEEL_LEVEL_OVERDUE 0xFF
+
+typedef struct st_picowheel_node_t {
+    struct st_picowheel_node_t* next;
+    struct st_picowheel_node_t* previous;
+    uint64_t wake_time;
+    uint8_t level;
+    uint8_t slot;
+    unsigned int is_inserted : 1;
+} picowheel_node_t;
+
+typedef struct st_picowheel_list_t {
+    picowheel_node_t* first;
+    picowheel_node_t* last;
+} picowheel_list_t;
+
+typedef struct st_picowheel_t {
+    uint64_t wheel_time;
+    picowheel_list_t overdue;
+    picowheel_list_t slots[PICOWHEEL_NB_LEVELS][PICOWHEEL_NB_SLOTS];
+    uint64_t bitmap[PICOWHEEL_NB_LEVELS][PICOWHEEL_NB_SLOTS / 64];
+    /* Cache of the earliest node in the first non empty slot, when that
+     * slot is above level 0 and had to be scanned */
+    picowheel_node_t* min_cache;
+    int size;
+} picowheel_t;
+
+void picowheel_init(picowheel_t* wheel, uint64_t start_time);
+picowheel_t* picowheel_new(uint64_t start_time);
+void picowheel_delete(picowheel_t* wheel);
+void picowheel_insert(picowheel_t* wheel, picowheel_node_t* node, uint64_t wake_time);
+void picowheel_remove(picowheel_t* wheel, picowheel_node_t* node);
+picowheel_node_t* picowheel_first(picowheel_t* wheel);
+void picowheel_advance(picowheel_t* wheel, uint64_t current_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOWHEEL_H */
@@ -0,0 +1,237 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* PMTU cache.
+*
+* Each time an MTU probe is acknowledged, the context saves the new path
+* MTU, indexed by the peer address. When a path to the same address is
+* created, the cached value is the first probe tried by the PMTU discovery,
+* and that probe is sent as soon as the handshake completes instead of
+* waiting for enough queued data. If the probe is lost, the record is
+* dropped and the discovery proceeds with the regular search.
+*
+* Records expire after a lifetime, and the least recently saved records are
+* evicted when the cache is full.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+#define PICOQUIC_PMTU_CACHE_LIFETIME (600ull * 1000000ull)
+
+static uint64_t picoquic_pmtu_record_hash(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_pmtu_record_t* record = (const picoquic_pmtu_record_t*)key;
+
+    return picohash_siphash(record->ip_addr, record->ip_addr_length, hash_seed);
+}
+
+static int picoquic_pmtu_record_compare(const void* key1, const void* key2)
+{
+    const picoquic_pmtu_record_t* record1 = (const picoquic_pmtu_record_t*)key1;
+    const picoquic_pmtu_record_t* record2 = (const picoquic_pmtu_record_t*)key2;
+
+    return (record1->ip_addr_length == record2->ip_addr_length &&
+        memcmp(record1->ip_addr, record2->ip_addr, record1->ip_addr_length) == 0) ? 0 : 1;
+}
+
+static picohash_item* picoquic_pmtu_record_to_item(const void* key)
+{
+    picoquic_pmtu_record_t* record = (picoquic_pmtu_record_t*)key;
+
+    return &record->hash_item;
+}
+
+int picoquic_set_pmtu_cache(picoquic_quic_t* quic, size_t max_records, uint64_t lifetime)
+{
+    int ret = 0;
+
+    picoquic_pmtu_cache_free(quic);
+
+    if (max_records > 0) {
+        picoquic_pmtu_cache_t* pmtu_cache = (picoquic_pmtu_cache_t*)malloc(sizeof(picoquic_pmtu_cache_t));
+
+        if (pmtu_cache == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(pmtu_cache, 0, sizeof(picoquic_pmtu_cache_t));
+            pmtu_cache->max_records = max_records;
+            pmtu_cache->lifetime = (lifetime == 0) ? PICOQUIC_PMTU_CACHE_LIFETIME : lifetime;
+            pmtu_cache->table = picohash_create_ex(max_records, picoquic_pmtu_record_hash,
+                picoquic_pmtu_record_compare, picoquic_pmtu_record_to_item, quic->hash_seed);
+            if (pmtu_cache->table == NULL) {
+                free(pmtu_cache);
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                quic->pmtu_cache = pmtu_cache;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static void picoquic_pmtu_record_delete(picoquic_pmtu_cache_t* pmtu_cache, picoquic_pmtu_record_t* record)
+{
+    if (record->next_record == NULL) {
+        pmtu_cache->last = record->previous_record;
+    }
+    else {
+        record->next_record->previous_record = record->previous_record;
+    }
+
+    if (record->previous_record == NULL) {
+        pmtu_cache->first = record->next_record;
+    }
+    else {
+        record->previous_record->next_record = record->next_record;
+    }
+
+    picohash_delete_key(pmtu_cache->table, record, 1);
+
+    if (pmtu_cache->nb_records > 0) {
+        pmtu_cache->nb_records--;
+    }
+}
+
+void picoquic_pmtu_cache_free(picoquic_quic_t* quic)
+{
+    if (quic->pmtu_cache != NULL) {
+        while (quic->pmtu_cache->first != NULL) {
+            picoquic_pmtu_record_delete(quic->pmtu_cache, quic->pmtu_cache->first);
+        }
+        picohash_delete(quic->pmtu_cache->table, 1);
+        free(quic->pmtu_cache);
+        quic->pmtu_cache = NULL;
+    }
+}
+
+static picoquic_pmtu_record_t* picoquic_pmtu_cache_find(picoquic_quic_t* quic,
+    const struct sockaddr* peer_addr, uint64_t current_time)
+{
+    picoquic_pmtu_record_t* record = NULL;
+    uint8_t* ip_addr = NULL;
+    uint8_t ip_addr_length = 0;
+
+    if (quic->pmtu_cache != NULL && peer_addr != NULL) {
+        picoquic_get_ip_addr((struct sockaddr*)peer_addr, &ip_addr, &ip_addr_length);
+    }
+
+    if (ip_addr != NULL && ip_addr_length > 0 && ip_addr_length <= PICOQUIC_STORED_IP_MAX) {
+        picoquic_pmtu_record_t key;
+        picohash_item* item;
+
+        memset(&key, 0, sizeof(key));
+        memcpy(key.ip_addr, ip_addr, ip_addr_length);
+        key.ip_addr_length = ip_addr_length;
+
+        item = picohash_retrieve(quic->pmtu_cache->table, &key);
+        if (item != NULL) {
+            record = (picoquic_pmtu_record_t*)item->key;
+            if (record->saved_time + quic->pmtu_cache->lifetime <= current_time) {
+                picoquic_pmtu_record_delete(quic->pmtu_cache, record);
+                record = NULL;
+            }
+        }
+    }
+
+    return record;
+}
+
+/* Called when a path is created. Returns 0 if nothing is cached. */
+size_t picoquic_pmtu_cache_get(picoquic_quic_t* quic, const struct sockaddr* peer_addr, uint64_t current_time)
+{
+    size_t mtu = 0;
+    picoquic_pmtu_record_t* record = picoquic_pmtu_cache_find(quic, peer_addr, current_time);
+
+    if (record != NULL) {
+        mtu = record->mtu;
+        quic->pmtu_cache->nb_hits++;
+    }
+
+    return mtu;
+}
+
+/* Called when an MTU probe is acknowledged */
+void picoquic_pmtu_cache_save(picoquic_quic_t* quic, const struct sockaddr* peer_addr, size_t mtu, uint64_t current_time)
+{
+    picoquic_pmtu_cache_t* pmtu_cache = quic->pmtu_cache;
+    uint8_t* ip_addr = NULL;
+    uint8_t ip_addr_length = 0;
+
+    if (pmtu_cache != NULL && peer_addr != NULL) {
+        picoquic_get_ip_addr((struct sockaddr*)peer_addr, &ip_addr, &ip_addr_length);
+    }
+
+    if (ip_addr != NULL && ip_addr_length > 0 && ip_addr_length <= PICOQUIC_STORED_IP_MAX) {
+        picoquic_pmtu_record_t* record = picoquic_pmtu_cache_find(quic, peer_addr, current_time);
+
+        if (record != NULL) {
+            picoquic_pmtu_record_delete(pmtu_cache, record);
+        }
+        while (pmtu_cache->nb_records >= pmtu_cache->max_records && pmtu_cache->last != NULL) {
+            picoquic_pmtu_record_delete(pmtu_cache, pmtu_cache->last);
+        }
+        record = (picoquic_pmtu_record_t*)malloc(sizeof(picoquic_pmtu_record_t));
+        if (record != NULL) {
+            memset(record, 0, sizeof(picoquic_pmtu_record_t));
+            memcpy(record->ip_addr, ip_addr, ip_addr_length);
+            record->ip_addr_length = ip_addr_length;
+            record->saved_time = current_time;
+            record->mtu = mtu;
+            record->next_record = pmtu_cache->first;
+            if (record->next_record == NULL) {
+                pmtu_cache->last = record;
+            }
+            else {
+                record->next_record->previous_record = record;
+            }
+            pmtu_cache->first = record;
+            if (picohash_insert(pmtu_cache->table, record) == 0) {
+                pmtu_cache->nb_records++;
+            }
+            else {
+                pmtu_cache->first = record->next_record;
+                if (pmtu_cache->first == NULL) {
+                    pmtu_cache->last = NULL;
+                }
+                else {
+                    pmtu_cache->first->previous_record = NULL;
+                }
+                free(record);
+            }
+        }
+    }
+}
+
+/* Called when the probe of the cached value is lost */
+void picoquic_pmtu_cache_forget(picoquic_quic_t* quic, const struct sockaddr* peer_addr)
+{
+    picoquic_pmtu_record_t* record = picoquic_pmtu_cache_find(quic, peer_addr, 0);
+
+    if (record != NULL) {
+        picoquic_pmtu_record_delete(quic->pmtu_cache, record);
+    }
+}
@@ -41,6 +41,12 @@
  *   in Prague spec.
  * - reset the L3S computation on "enter_recovery". This is a useful but
  *   imperfect attempt at avoiding "double dipping".
+ * - when the CE marks can be attributed to acknowledged packets (see
+ *   picoquic_process_ack_range), "frac" is computed per round as the
+ *   fraction of acknowledged bytes that were marked, instead of the
+ *   fraction of marked packets in the ECN counts. The per ACK processing
+ *   only adds the byte counts, and alpha is updated once per round, with
+ *   integer arithmetic only.
  * 
  */
 
@@ -110,7 +116,10 @@ typedef struct st_picoquic_prague_state_t {
     uint64_t l4s_epoch_send;
     uint64_t l4s_epoch_ect1;
     uint64_t l4s_epoch_ce;
+    uint64_t l4s_round_acked; /* Bytes acknowledged in the current round */
+    uint64_t l4s_round_ce_marked; /* Part of these bytes in packets with attributed CE marks */
     picoquic_min_max_rtt_t rtt_filter;
+    picoquic_hystart_pp_t hspp;
 } picoquic_prague_state_t;
 
 static void picoquic_prague_init_reno(picoquic_prague_state_t* pr_state, picoquic_path_t* path_x)
@@ -126,7 +135,6 @@ void picoquic_prague_init(picoquic_cnx_t * cnx, picoquic_path_t* path_x, char co
     /* Initialize the state of the congestion control algorithm */
     picoquic_prague_state_t* pr_state = (picoquic_prague_state_t*)malloc(sizeof(picoquic_prague_state_t));
 #ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(cnx);
     UNREFERENCED_PARAMETER(option_string);
 #endif
 
@@ -134,6 +142,7 @@ void picoquic_prague_init(picoquic_cnx_t * cnx, picoquic_path_t* path_x, char co
         memset(pr_state, 0, sizeof(picoquic_prague_state_t));
         path_x->congestion_alg_state = (void*)pr_state;
         picoquic_prague_init_reno(pr_state, path_x);
+        picoquic_hystart_pp_reset(&pr_state->hspp, cnx, path_x);
     }
     else {
         path_x->congestion_alg_state = NULL;
@@ -159,9 +168,10 @@ static void picoquic_prague_reset_l3s(picoquic_cnx_t* cnx, picoquic_prague_state
     pr_state->l4s_epoch_send = pkt_ctx->send_sequence;
     pr_state->l4s_epoch_ect1 = pkt_ctx->ecn_ect1_total_remote;
     pr_state->l4s_epoch_ce = pkt_ctx->ecn_ce_total_remote;
+    pr_state->l4s_round_acked = 0;
+    pr_state->l4s_round_ce_marked = 0;
     pr_state->alpha = 0;
     pr_state->alpha_shifted = 0;
-
 }
 
 
@@ -169,6 +179,7 @@ static void picoquic_prague_reset(picoquic_cnx_t * cnx, picoquic_prague_state_t*
 {
     picoquic_prague_init_reno(pr_state, path_x);
     picoquic_prague_reset_l3s(cnx, pr_state, path_x);
+    picoquic_hystart_pp_reset(&pr_state->hspp, cnx, path_x);
 }
 
 
@@ -203,12 +214,16 @@ static void picoquic_prague_enter_recovery(
 }
 
 static void picoquic_prague_update_alpha(picoquic_cnx_t* cnx,
-    picoquic_path_t* path_x, picoquic_prague_state_t* pr_state, uint64_t nb_bytes_acknowledged, uint64_t current_time)
+    picoquic_path_t* path_x, picoquic_prague_state_t* pr_state, uint64_t nb_bytes_acknowledged,
+    uint64_t nb_bytes_ce_marked, uint64_t current_time)
 {
     /* Check the L4S epoch, based on first number sent in previous epoch */
     picoquic_packet_context_t* pkt_ctx = picoquic_prague_get_pkt_ctx(cnx, path_x);
     uint64_t update_sent = pkt_ctx->latest_time_acknowledged;
 
+    pr_state->l4s_round_acked += nb_bytes_acknowledged;
+    pr_state->l4s_round_ce_marked += nb_bytes_ce_marked;
+
     if (pkt_ctx->highest_acknowledged != UINT64_MAX &&
         pkt_ctx->highest_acknowledged > pr_state->l4s_epoch_send) {
         /* The epoch packet has been acked. Time to update alpha. */
@@ -218,12 +233,18 @@ static void picoquic_prague_update_alpha(picoquic_cnx_t* cnx,
         uint64_t delta_ect1 = pkt_ctx->ecn_ect1_total_remote - pr_state->l4s_epoch_ect1;
         uint64_t delta_ce = pkt_ctx->ecn_ce_total_remote - pr_state->l4s_epoch_ce;
 
-        if (delta_ce > 0) {
+        if (pr_state->l4s_round_ce_marked > 0 && pr_state->l4s_round_acked >= pr_state->l4s_round_ce_marked) {
+            /* Marks were attributed to acknowledged packets, use the fraction of bytes. */
+            frac = (pr_state->l4s_round_ce_marked * 1024) / pr_state->l4s_round_acked;
+        }
+        else if (delta_ce > 0) {
             frac = (delta_ce * 1024) / (delta_ce + delta_ect1);
         }
         else {
             frac = 0;
         }
+        pr_state->l4s_round_acked = 0;
+        pr_state->l4s_round_ce_marked = 0;
 
         if (pr_state->l4s_update_sent != 0 && frac > 512 && pr_state->alpha < 128 &&
             update_sent - pr_state->l4s_update_sent > path_x->smoothed_rtt) {
@@ -288,6 +309,9 @@ void picoquic_prague_notify(
     picoquic_prague_state_t* pr_state = (picoquic_prague_state_t*)path_x->congestion_alg_state;
 
     if (pr_state != NULL) {
+        int is_initial_slow_start = (pr_state->alg_state == picoquic_prague_alg_slow_start &&
+            pr_state->ssthresh == UINT64_MAX);
+
         switch (notification) {
         /* RTT measurements will happen before acknowledgement is signalled */
         case picoquic_congestion_notification_acknowledgement: {
@@ -298,14 +322,16 @@ void picoquic_prague_notify(
             }
 
             /* Regardless of the alg state, update alpha */
-            picoquic_prague_update_alpha(cnx, path_x, pr_state, ack_state->nb_bytes_acknowledged, current_time);
+            picoquic_prague_update_alpha(cnx, path_x, pr_state, ack_state->nb_bytes_acknowledged,
+                ack_state->nb_bytes_ce_marked, current_time);
 
             /* Increase or reduce the congestion window based on alpha */
             switch (pr_state->alg_state) {
             case picoquic_prague_alg_slow_start:
                 /* TODO l4s_prague test fails. Have to increase max_completion time about 100 ms */
                 if (path_x->last_time_acked_data_frame_sent > path_x->last_sender_limited_time) {
-                    path_x->cwin += picoquic_cc_slow_start_increase_ex2(path_x, ack_state->nb_bytes_acknowledged, 0, pr_state->alpha);
+                    path_x->cwin += picoquic_cc_slow_start_increase_ex2(path_x, ack_state->nb_bytes_acknowledged,
+                        picoquic_hystart_pp_in_css(&pr_state->hspp), pr_state->alpha);
 
                     /* if cnx->cwin exceeds SSTHRESH, exit and go to CA */
                     if (path_x->cwin >= pr_state->ssthresh) {
@@ -364,9 +390,11 @@ void picoquic_prague_notify(
                     path_x->cwin = picoquic_cc_update_cwin_for_long_rtt(path_x);
                 }
 
-                /* HyStart. */
+                /* HyStart, or HyStart++ if enabled. */
                 /* Using RTT increases as signal to get out of initial slow start */
-                if (picoquic_cc_hystart_test(&pr_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
+                if ((pr_state->hspp.is_enabled) ?
+                    picoquic_hystart_pp_test(&pr_state->hspp, cnx, path_x, ack_state->rtt_measurement) :
+                    picoquic_cc_hystart_test(&pr_state->rtt_filter, (cnx->is_time_stamp_enabled) ? ack_state->one_way_delay : ack_state->rtt_measurement,
                     cnx->path[0]->pacing.packet_time_microsec, current_time,
                     cnx->is_time_stamp_enabled)) {
                     /* RTT increased too much, get out of slow start! */
@@ -384,6 +412,10 @@ void picoquic_prague_notify(
             break;
         }
 
+        if (is_initial_slow_start && pr_state->ssthresh != UINT64_MAX) {
+            picoquic_cc_record_slow_start_exit(path_x, &pr_state->hspp, notification, current_time);
+        }
+
         /* Compute pacing data */
         picoquic_update_pacing_data(cnx, path_x, pr_state->alg_state == picoquic_prague_alg_slow_start &&
             pr_state->ssthresh == UINT64_MAX);
@@ -408,6 +440,57 @@ void picoquic_prague_observe(picoquic_path_t* path_x, uint64_t* cc_state, uint64
     *cc_param = (pr_state->ssthresh == UINT64_MAX) ? 0 : pr_state->ssthresh;
 }
 
+/* Export and import the state of congestion control.
+ * The L4S epoch counters refer to packet numbers and ECN counts of the
+ * exporting connection, so they are reset at import; the smoothed
+ * fraction of marks "alpha" is kept.
+ */
+static uint8_t* picoquic_prague_export(picoquic_path_t* path_x, uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_prague_state_t* pr_state = (picoquic_prague_state_t*)path_x->congestion_alg_state;
+    uint64_t values[5];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    values[0] = (uint64_t)pr_state->alg_state;
+    values[1] = pr_state->ssthresh;
+    values[2] = pr_state->alpha;
+    values[3] = pr_state->alpha_shifted;
+    values[4] = pr_state->residual_ack;
+
+    return picoquic_cc_snapshot_encode(bytes, bytes_max, values, 5);
+}
+
+static const uint8_t* picoquic_prague_import(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes, const uint8_t* bytes_max, uint64_t current_time)
+{
+    picoquic_prague_state_t* pr_state = (picoquic_prague_state_t*)path_x->congestion_alg_state;
+    uint64_t values[5];
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    if ((bytes = picoquic_cc_snapshot_decode(bytes, bytes_max, values, 5)) != NULL) {
+        if (values[0] > picoquic_prague_alg_congestion_avoidance || values[2] > 1024) {
+            bytes = NULL;
+        }
+        else {
+            picoquic_prague_reset_l3s(cnx, pr_state, path_x);
+            pr_state->alg_state = (picoquic_prague_alg_state_t)values[0];
+            pr_state->ssthresh = values[1];
+            pr_state->alpha = values[2];
+            pr_state->alpha_shifted = values[3];
+            pr_state->residual_ack = values[4];
+            pr_state->recovery_start = 0;
+            pr_state->l4s_update_sent = 0;
+            picoquic_update_pacing_data(cnx, path_x, pr_state->alg_state == picoquic_prague_alg_slow_start &&
+                pr_state->ssthresh == UINT64_MAX);
+        }
+    }
+
+    return bytes;
+}
+
 /* Definition record for the Prague algorithm */
 
 #define PICOQUIC_PRAGUE_ID "prague" 
@@ -417,7 +500,9 @@ picoquic_congestion_algorithm_t picoquic_prague_algorithm_struct = {
     picoquic_prague_init,
     picoquic_prague_notify,
     picoquic_prague_delete,
-    picoquic_prague_observe
+    picoquic_prague_observe,
+    picoquic_prague_export,
+    picoquic_prague_import
 };
 
 picoquic_congestion_algorithm_t* picoquic_prague_algorithm = &picoquic_prague_algorithm_struct;
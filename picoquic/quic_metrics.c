@@ -0,0 +1,391 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Context metrics.
+*
+* The counters are aggregated per quic context, and updated by the network
+* thread as packets are received and sent, losses detected, and handshakes
+* completed. They are never read directly by other threads. Instead, the
+* network thread publishes a copy of the counters at most once per publish
+* interval, together with gauges such as the number of active connections,
+* the occupancy of the packet and object pools, and the size of the wake list.
+*
+* The publication uses two slots, with the sequence number protocol used
+* for the congestion control telemetry: publication n is copied in slot
+* n % 2, after setting the slot sequence to 2*n+1, and the sequence is set
+* to 2*(n+1) after the copy. A reader copies the slot of the last publication
+* and checks that the sequence did not change during the copy. Publications
+* are spaced by the publish interval, so retries are rare, and the network
+* thread never waits for the readers.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+
+#define PICOQUIC_METRICS_READ_ATTEMPTS 8
+
+static const uint64_t picoquic_metrics_bucket_bound[PICOQUIC_METRICS_NB_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000 };
+
+static const char* picoquic_metrics_bucket_label[PICOQUIC_METRICS_NB_BUCKETS] = {
+    "0.001", "0.002", "0.005", "0.01", "0.02", "0.05", "0.1", "0.2", "0.5", "1.0", "+Inf" };
+
+int picoquic_enable_quic_metrics(picoquic_quic_t* quic, uint64_t publish_interval)
+{
+    int ret = 0;
+
+    if (quic->metrics == NULL) {
+        quic->metrics = (picoquic_quic_metrics_ctx_t*)malloc(sizeof(picoquic_quic_metrics_ctx_t));
+        if (quic->metrics == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(quic->metrics, 0, sizeof(picoquic_quic_metrics_ctx_t));
+        }
+    }
+    if (ret == 0) {
+        quic->metrics->publish_interval = (publish_interval == 0) ? PICOQUIC_METRICS_INTERVAL : publish_interval;
+        quic->metrics->next_publish_time = 0;
+    }
+
+    return ret;
+}
+
+/* Must not be called while other threads may read the metrics */
+void picoquic_disable_quic_metrics(picoquic_quic_t* quic)
+{
+    if (quic->metrics != NULL) {
+        free(quic->metrics);
+        quic->metrics = NULL;
+    }
+}
+
+void picoquic_metrics_histogram_add(picoquic_metrics_histogram_t* histogram, uint64_t value)
+{
+    int i = 0;
+
+    while (i < PICOQUIC_METRICS_NB_BUCKETS - 1 && value > picoquic_metrics_bucket_bound[i]) {
+        i++;
+    }
+    histogram->bucket[i]++;
+    histogram->nb_samples++;
+    histogram->sum += value;
+}
+
+void picoquic_latency_histogram_add(picoquic_latency_histogram_t* histogram, uint64_t value)
+{
+    int i = 0;
+
+    while (i < PICOQUIC_LATENCY_NB_BUCKETS - 1 && value > (1ull << i)) {
+        i++;
+    }
+    histogram->bucket[i]++;
+    histogram->nb_samples++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+void picoquic_metrics_handshake_done(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_quic_metrics_ctx_t* metrics = cnx->quic->metrics;
+
+    if (metrics != NULL) {
+        metrics->live.nb_handshakes++;
+        picoquic_metrics_histogram_add(&metrics->live.handshake_time,
+            (current_time > cnx->start_time) ? current_time - cnx->start_time : 0);
+    }
+}
+
+/* With GSO, the send buffer holds several datagrams of segment_size bytes */
+void picoquic_metrics_datagrams_sent(picoquic_quic_t* quic, size_t send_length, size_t segment_size)
+{
+    picoquic_quic_metrics_ctx_t* metrics = quic->metrics;
+
+    if (metrics != NULL && send_length > 0) {
+        metrics->live.nb_datagrams_sent += (segment_size == 0 || segment_size >= send_length) ? 1 :
+            (send_length + segment_size - 1) / segment_size;
+        metrics->live.nb_bytes_sent += send_length;
+    }
+}
+
+static void picoquic_metrics_update_gauges(picoquic_quic_t* quic, picoquic_quic_metrics_t* live)
+{
+    live->nb_active_connections = quic->current_number_connections;
+    live->nb_half_open_connections = quic->current_number_half_open;
+    live->nb_stateless_dropped = quic->nb_stateless_packets_dropped;
+    live->nb_packets_allocated = (uint64_t)quic->nb_packets_allocated;
+    live->nb_packets_in_pool = (uint64_t)quic->nb_packets_in_pool;
+    live->nb_data_nodes_allocated = (uint64_t)quic->nb_data_nodes_allocated;
+    live->nb_data_nodes_in_pool = (uint64_t)quic->nb_data_nodes_in_pool;
+    live->nb_objects_in_use = 0;
+    live->nb_objects_in_pool = 0;
+    for (int i = 0; i < picoquic_object_type_max; i++) {
+        live->nb_objects_in_use += quic->object_pool[i].stats.nb_in_use;
+        live->nb_objects_in_pool += quic->object_pool[i].stats.nb_in_pool;
+    }
+    live->wake_list_size = (uint64_t)((quic->cnx_wake_wheel != NULL) ?
+        quic->cnx_wake_wheel->size : quic->cnx_wake_tree.size);
+}
+
+void picoquic_publish_quic_metrics(picoquic_quic_t* quic, uint64_t current_time)
+{
+    picoquic_quic_metrics_ctx_t* metrics = quic->metrics;
+
+    if (metrics != NULL) {
+        uint64_t n = metrics->nb_published;
+        picoquic_quic_metrics_slot_t* slot = &metrics->slot[n % 2];
+        picoquic_quic_metrics_t* live = &metrics->live;
+
+        live->sequence = n + 1;
+        live->publish_time = current_time;
+        if (n > 0 && current_time > metrics->last_publish_time) {
+            live->handshake_rate = ((live->nb_handshakes - metrics->last_nb_handshakes) * 1000000) /
+                (current_time - metrics->last_publish_time);
+        }
+        picoquic_metrics_update_gauges(quic, live);
+
+        PICOQUIC_TELEMETRY_STORE64(&slot->seq, 2 * n + 1);
+        PICOQUIC_TELEMETRY_WRITE_FENCE();
+        memcpy((void*)&slot->metrics, live, sizeof(picoquic_quic_metrics_t));
+        PICOQUIC_TELEMETRY_STORE64(&slot->seq, 2 * (n + 1));
+        PICOQUIC_TELEMETRY_STORE64(&metrics->nb_published, n + 1);
+
+        metrics->last_publish_time = current_time;
+        metrics->last_nb_handshakes = live->nb_handshakes;
+        metrics->next_publish_time = current_time + metrics->publish_interval;
+    }
+}
+
+/* Called by any thread. Returns -1 if nothing was published yet. */
+int picoquic_get_quic_metrics(picoquic_quic_t* quic, picoquic_quic_metrics_t* metrics)
+{
+    int ret = -1;
+    picoquic_quic_metrics_ctx_t* ctx = quic->metrics;
+
+    if (ctx != NULL) {
+        for (int i = 0; ret != 0 && i < PICOQUIC_METRICS_READ_ATTEMPTS; i++) {
+            uint64_t n = PICOQUIC_TELEMETRY_LOAD64(&ctx->nb_published);
+            picoquic_quic_metrics_slot_t* slot;
+
+            if (n == 0) {
+                break;
+            }
+            slot = &ctx->slot[(n - 1) % 2];
+            if (PICOQUIC_TELEMETRY_LOAD64(&slot->seq) == 2 * n) {
+                memcpy(metrics, (const void*)&slot->metrics, sizeof(picoquic_quic_metrics_t));
+                PICOQUIC_TELEMETRY_READ_FENCE();
+                if (PICOQUIC_TELEMETRY_LOAD64(&slot->seq) == 2 * n) {
+                    ret = 0;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* OpenMetrics text format. Counter samples carry the "_total" suffix,
+ * and time values are expressed in seconds. */
+typedef struct st_picoquic_metrics_field_t {
+    char const* name;
+    char const* type;
+    char const* help;
+    size_t offset;
+} picoquic_metrics_field_t;
+
+static const picoquic_metrics_field_t picoquic_metrics_fields[] = {
+    { "picoquic_connections_created", "counter", "Connections created",
+        offsetof(picoquic_quic_metrics_t, nb_connections_created) },
+    { "picoquic_connections_deleted", "counter", "Connections deleted",
+        offsetof(picoquic_quic_metrics_t, nb_connections_deleted) },
+    { "picoquic_handshakes", "counter", "Handshakes completed",
+        offsetof(picoquic_quic_metrics_t, nb_handshakes) },
+    { "picoquic_handshake_rate", "gauge", "Handshakes per second over the last interval",
+        offsetof(picoquic_quic_metrics_t, handshake_rate) },
+    { "picoquic_active_connections", "gauge", "Connections in the context",
+        offsetof(picoquic_quic_metrics_t, nb_active_connections) },
+    { "picoquic_half_open_connections", "gauge", "Server connections not yet ready",
+        offsetof(picoquic_quic_metrics_t, nb_half_open_connections) },
+    { "picoquic_packets_received", "counter", "QUIC packets received",
+        offsetof(picoquic_quic_metrics_t, nb_packets_received) },
+    { "picoquic_packets_sent", "counter", "QUIC packets sent",
+        offsetof(picoquic_quic_metrics_t, nb_packets_sent) },
+    { "picoquic_datagrams_received", "counter", "UDP datagrams received",
+        offsetof(picoquic_quic_metrics_t, nb_datagrams_received) },
+    { "picoquic_datagrams_sent", "counter", "UDP datagrams sent",
+        offsetof(picoquic_quic_metrics_t, nb_datagrams_sent) },
+    { "picoquic_received_bytes", "counter", "Bytes received in UDP datagrams",
+        offsetof(picoquic_quic_metrics_t, nb_bytes_received) },
+    { "picoquic_sent_bytes", "counter", "Bytes sent in UDP datagrams",
+        offsetof(picoquic_quic_metrics_t, nb_bytes_sent) },
+    { "picoquic_packets_lost", "counter", "Packets declared lost",
+        offsetof(picoquic_quic_metrics_t, nb_packets_lost) },
+    { "picoquic_spurious_losses", "counter", "Losses found spurious",
+        offsetof(picoquic_quic_metrics_t, nb_spurious_losses) },
+    { "picoquic_stateless_dropped", "counter", "Stateless packets dropped",
+        offsetof(picoquic_quic_metrics_t, nb_stateless_dropped) },
+    { "picoquic_packets_allocated", "gauge", "Packet buffers allocated",
+        offsetof(picoquic_quic_metrics_t, nb_packets_allocated) },
+    { "picoquic_packets_in_pool", "gauge", "Packet buffers in the free pool",
+        offsetof(picoquic_quic_metrics_t, nb_packets_in_pool) },
+    { "picoquic_data_nodes_allocated", "gauge", "Stream data nodes allocated",
+        offsetof(picoquic_quic_metrics_t, nb_data_nodes_allocated) },
+    { "picoquic_data_nodes_in_pool", "gauge", "Stream data nodes in the free pool",
+        offsetof(picoquic_quic_metrics_t, nb_data_nodes_in_pool) },
+    { "picoquic_objects_in_use", "gauge", "Pooled objects in use",
+        offsetof(picoquic_quic_metrics_t, nb_objects_in_use) },
+    { "picoquic_objects_in_pool", "gauge", "Pooled objects in the free pool",
+        offsetof(picoquic_quic_metrics_t, nb_objects_in_pool) },
+    { "picoquic_wake_list_size", "gauge", "Connections waiting in the wake list",
+        offsetof(picoquic_quic_metrics_t, wake_list_size) }
+};
+
+static const size_t picoquic_nb_metrics_fields = sizeof(picoquic_metrics_fields) / sizeof(picoquic_metrics_field_t);
+
+static int picoquic_format_histogram(char* buf, size_t buf_size, size_t* length, char const* name, char const* help,
+    const picoquic_metrics_histogram_t* histogram)
+{
+    size_t nb_chars = 0;
+    uint64_t cumulative = 0;
+    int ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+        "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n", name, name, name, help);
+
+    for (int i = 0; ret == 0 && i < PICOQUIC_METRICS_NB_BUCKETS; i++) {
+        *length += nb_chars;
+        cumulative += histogram->bucket[i];
+        ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+            "%s_bucket{le=\"%s\"} %" PRIu64 "\n", name, picoquic_metrics_bucket_label[i], cumulative);
+    }
+    if (ret == 0) {
+        *length += nb_chars;
+        ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+            "%s_sum %" PRIu64 ".%06" PRIu64 "\n%s_count %" PRIu64 "\n", name,
+            histogram->sum / 1000000, histogram->sum % 1000000, name, histogram->nb_samples);
+    }
+    if (ret == 0) {
+        *length += nb_chars;
+    }
+
+    return ret;
+}
+
+static int picoquic_format_latency_histogram(char* buf, size_t buf_size, size_t* length, char const* name, char const* help,
+    const picoquic_latency_histogram_t* histogram)
+{
+    size_t nb_chars = 0;
+    uint64_t cumulative = 0;
+    int ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+        "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n", name, name, name, help);
+
+    for (int i = 0; ret == 0 && i < PICOQUIC_LATENCY_NB_BUCKETS; i++) {
+        *length += nb_chars;
+        cumulative += histogram->bucket[i];
+        if (i < PICOQUIC_LATENCY_NB_BUCKETS - 1) {
+            uint64_t bound = 1ull << i;
+            ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+                "%s_bucket{le=\"%" PRIu64 ".%06" PRIu64 "\"} %" PRIu64 "\n", name,
+                bound / 1000000, bound % 1000000, cumulative);
+        }
+        else {
+            ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+                "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, cumulative);
+        }
+    }
+    if (ret == 0) {
+        *length += nb_chars;
+        ret = picoquic_sprintf(buf + *length, buf_size - *length, &nb_chars,
+            "%s_sum %" PRIu64 ".%06" PRIu64 "\n%s_count %" PRIu64 "\n", name,
+            histogram->sum / 1000000, histogram->sum % 1000000, name, histogram->nb_samples);
+    }
+    if (ret == 0) {
+        *length += nb_chars;
+    }
+
+    return ret;
+}
+
+size_t picoquic_format_openmetrics(const picoquic_quic_metrics_t* metrics, char* buf, size_t buf_size)
+{
+    size_t length = 0;
+    size_t nb_chars = 0;
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < picoquic_nb_metrics_fields; i++) {
+        const picoquic_metrics_field_t* field = &picoquic_metrics_fields[i];
+        uint64_t value = *(const uint64_t*)(((const uint8_t*)metrics) + field->offset);
+        int is_counter = (field->type[0] == 'c');
+
+        ret = picoquic_sprintf(buf + length, buf_size - length, &nb_chars,
+            "# TYPE %s %s\n# HELP %s %s\n%s%s %" PRIu64 "\n", field->name, field->type,
+            field->name, field->help, field->name, (is_counter) ? "_total" : "", value);
+        if (ret == 0) {
+            length += nb_chars;
+        }
+    }
+    if (ret == 0) {
+        ret = picoquic_format_histogram(buf, buf_size, &length, "picoquic_rtt_seconds",
+            "RTT samples", &metrics->rtt);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_histogram(buf, buf_size, &length, "picoquic_handshake_time_seconds",
+            "Time from connection creation to handshake completion", &metrics->handshake_time);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_latency_histogram(buf, buf_size, &length, "picoquic_loop_wait_seconds",
+            "Time waiting for packets or timers in the packet loop", &metrics->loop_latency.wait);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_latency_histogram(buf, buf_size, &length, "picoquic_loop_receive_seconds",
+            "Time processing a batch of received packets", &metrics->loop_latency.receive);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_latency_histogram(buf, buf_size, &length, "picoquic_loop_prepare_seconds",
+            "Time preparing a packet", &metrics->loop_latency.prepare);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_latency_histogram(buf, buf_size, &length, "picoquic_loop_send_seconds",
+            "Time in the send system calls", &metrics->loop_latency.send);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_latency_histogram(buf, buf_size, &length, "picoquic_loop_wake_lag_seconds",
+            "Delay between the planned wake time and the end of the wait", &metrics->loop_latency.wake_lag);
+    }
+    if (ret == 0) {
+        ret = picoquic_format_latency_histogram(buf, buf_size, &length, "picoquic_loop_spin_seconds",
+            "Time polling without blocking in busy poll mode", &metrics->loop_latency.spin);
+    }
+    if (ret == 0) {
+        ret = picoquic_sprintf(buf + length, buf_size - length, &nb_chars, "# EOF\n");
+        length += nb_chars;
+    }
+
+    return (ret == 0) ? length : 0;
+}
@@ -25,6 +25,7 @@
 #include "picoquic_utils.h"
 #include "picoquic_unified_log.h"
 #include "tls_api.h"
+#include "picoquic_packet_loop.h"
 #include <stdlib.h>
 #include <string.h>
 #ifndef _WINDOWS
@@ -32,6 +33,11 @@
 #include <time.h>
 #include <errno.h>
 #endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 #include "picoquic_newreno.h"
 
 /*
@@ -287,6 +293,13 @@ static uint64_t picoquic_net_id_hash(const void* key, const uint8_t* hash_seed)
     return picoquic_hash_addr((struct sockaddr*) & path_x->registered_peer_addr, hash_seed);
 }
 
+static uint64_t picoquic_net_id_hash13(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_path_t* path_x = (const picoquic_path_t*)key;
+
+    return picoquic_hash_addr_siphash13((struct sockaddr*) & path_x->registered_peer_addr, hash_seed);
+}
+
 static picohash_item * picoquic_local_netid_to_item(const void* key)
 {
     picoquic_path_t* path_x = (picoquic_path_t*)key;
@@ -303,19 +316,32 @@ static int picoquic_net_id_compare(const void* key1, const void* key2)
     return picoquic_compare_addr((struct sockaddr*) & path_x1->registered_peer_addr, (struct sockaddr*) & path_x2->registered_peer_addr);
 }
 
-static uint64_t picoquic_net_icid_hash(const void* key, const uint8_t* hash_seed)
+static size_t picoquic_net_icid_bytes(const picoquic_cnx_t* cnx, uint8_t* bytes)
 {
-    uint64_t h;
-    uint8_t bytes[18 + PICOQUIC_CONNECTION_ID_MAX_SIZE];
-    const picoquic_cnx_t* cnx = (const picoquic_cnx_t*)key;
     size_t l = picoquic_hash_addr_bytes((struct sockaddr*)&cnx->registered_icid_addr, bytes);
     memcpy(bytes + l, cnx->initial_cnxid.id, cnx->initial_cnxid.id_len);
     l += cnx->initial_cnxid.id_len;
+    return l;
+}
+
+static uint64_t picoquic_net_icid_hash(const void* key, const uint8_t* hash_seed)
+{
+    uint64_t h;
+    uint8_t bytes[18 + PICOQUIC_CONNECTION_ID_MAX_SIZE];
+    size_t l = picoquic_net_icid_bytes((const picoquic_cnx_t*)key, bytes);
     /* Using siphash, because CNX ID and IP address are chosen by third parties*/
     h = picohash_siphash(bytes, (uint32_t)l, hash_seed);
     return h;
 }
 
+static uint64_t picoquic_net_icid_hash13(const void* key, const uint8_t* hash_seed)
+{
+    uint8_t bytes[18 + PICOQUIC_CONNECTION_ID_MAX_SIZE];
+    size_t l = picoquic_net_icid_bytes((const picoquic_cnx_t*)key, bytes);
+
+    return picohash_siphash13(bytes, l, hash_seed);
+}
+
 static int picoquic_net_icid_compare(const void* key1, const void* key2)
 {
     const picoquic_cnx_t* cnx1 = (const picoquic_cnx_t*)key1;
@@ -335,19 +361,32 @@ static picohash_item * picoquic_net_icid_to_item(const void* key)
     return &cnx->registered_icid_item;
 }
 
-static uint64_t picoquic_net_secret_hash(const void* key, const uint8_t* hash_seed)
+static size_t picoquic_net_secret_bytes(const picoquic_cnx_t* cnx, uint8_t* bytes)
 {
-    uint64_t h;
-    uint8_t bytes[18 + PICOQUIC_RESET_SECRET_SIZE];
-    const picoquic_cnx_t* cnx = (const picoquic_cnx_t*)key;
     size_t l = picoquic_hash_addr_bytes((struct sockaddr*)&cnx->registered_secret_addr, bytes);
     memcpy(bytes + l, cnx->registered_reset_secret, PICOQUIC_RESET_SECRET_SIZE);
     l += PICOQUIC_RESET_SECRET_SIZE;
+    return l;
+}
+
+static uint64_t picoquic_net_secret_hash(const void* key, const uint8_t* hash_seed)
+{
+    uint64_t h;
+    uint8_t bytes[18 + PICOQUIC_RESET_SECRET_SIZE];
+    size_t l = picoquic_net_secret_bytes((const picoquic_cnx_t*)key, bytes);
     /* Using siphash, because secret and IP address are chosen by third parties*/
     h = picohash_siphash(bytes, (uint32_t)l, hash_seed);
     return h;
 }
 
+static uint64_t picoquic_net_secret_hash13(const void* key, const uint8_t* hash_seed)
+{
+    uint8_t bytes[18 + PICOQUIC_RESET_SECRET_SIZE];
+    size_t l = picoquic_net_secret_bytes((const picoquic_cnx_t*)key, bytes);
+
+    return picohash_siphash13(bytes, l, hash_seed);
+}
+
 static int picoquic_net_secret_compare(const void* key1, const void* key2)
 {
     const picoquic_cnx_t* cnx1 = (const picoquic_cnx_t*)key1;
@@ -517,88 +556,189 @@ int picoquic_remember_issued_ticket(picoquic_quic_t* quic,
 
 /* Token reuse management */
 
-static int64_t picoquic_registered_token_compare(void* l, void* r)
+static uint64_t picoquic_registered_token_hash(picoquic_quic_t* quic, uint64_t token_time, uint64_t token_hash)
 {
-    /* STream values are from 0 to 2^62-1, which means we are not worried with rollover */
-    picoquic_registered_token_t* rt_l = (picoquic_registered_token_t*)l;
-    picoquic_registered_token_t* rt_r = (picoquic_registered_token_t*)r;
-    int64_t ret = 0;
-    if (rt_l->token_time == rt_r->token_time) {
-        if (rt_l->token_hash > rt_r->token_hash) {
-            ret = 1;
-        }
-        else if (rt_l->token_hash < rt_r->token_hash) {
-            ret = -1;
+    uint8_t key[16];
+
+    picoformat_64(key, token_time);
+    picoformat_64(key + 8, token_hash);
+
+    return picohash_siphash(key, sizeof(key), quic->hash_seed);
+}
+
+int picoquic_registered_token_check_reuse(picoquic_quic_t * quic,
+    const uint8_t * token, size_t token_length, uint64_t expiry_time)
+{
+    int ret = -1;
+    picoquic_token_registry_t* registry = &quic->token_registry;
+
+    if (token_length >= 8) {
+        uint64_t token_hash = PICOPARSE_64(token + token_length - 8);
+        uint64_t h = picoquic_registered_token_hash(quic, expiry_time, token_hash);
+        size_t shard_id = (size_t)(h % PICOQUIC_TOKEN_REGISTRY_SHARDS);
+        picoquic_registered_token_t* shard = registry->shard[shard_id];
+
+        if (shard == NULL) {
+            shard = (picoquic_registered_token_t*)malloc(
+                PICOQUIC_TOKEN_REGISTRY_SHARD_SLOTS * sizeof(picoquic_registered_token_t));
+            if (shard != NULL) {
+                memset(shard, 0, PICOQUIC_TOKEN_REGISTRY_SHARD_SLOTS * sizeof(picoquic_registered_token_t));
+                registry->shard[shard_id] = shard;
+            }
+        }
+
+        if (shard != NULL) {
+            size_t first_slot = (size_t)((h / PICOQUIC_TOKEN_REGISTRY_SHARDS) % PICOQUIC_TOKEN_REGISTRY_SHARD_SLOTS);
+            picoquic_registered_token_t* free_rt = NULL;
+            picoquic_registered_token_t* oldest_rt = NULL;
+            int is_found = 0;
+
+            for (size_t i = 0; i < PICOQUIC_TOKEN_REGISTRY_PROBE; i++) {
+                picoquic_registered_token_t* rt = &shard[(first_slot + i) % PICOQUIC_TOKEN_REGISTRY_SHARD_SLOTS];
+
+                if (rt->count == 0 || rt->token_time < registry->expiry_floor) {
+                    if (free_rt == NULL) {
+                        free_rt = rt;
+                    }
+                }
+                else if (rt->token_time == expiry_time && rt->token_hash == token_hash) {
+                    rt->count++;
+                    DBG_PRINTF("Token reuse detected, count=%d", rt->count);
+                    is_found = 1;
+                    break;
+                }
+                else if (oldest_rt == NULL || rt->token_time < oldest_rt->token_time) {
+                    oldest_rt = rt;
+                }
+            }
+
+            if (!is_found) {
+                if (free_rt == NULL) {
+                    /* All slots in the window are live. Evict the one closest to expiry. */
+                    free_rt = oldest_rt;
+                    registry->nb_evicted++;
+                }
+                free_rt->token_time = expiry_time;
+                free_rt->token_hash = token_hash;
+                free_rt->count = 1;
+                ret = 0;
+            }
         }
     }
-    else if (rt_l->token_time > rt_r->token_time) {
-        ret = 1;
-    }
-    else {
-        ret = -1;
-    }
+
     return ret;
 }
 
-static picosplay_node_t* picoquic_registered_token_create(void* value)
+void picoquic_registered_token_clear(picoquic_quic_t* quic, uint64_t expiry_time_max)
 {
-    return &((picoquic_registered_token_t*)value)->registered_token_node;
+    /* Entries are reclaimed lazily, when their slot is probed */
+    if (expiry_time_max > quic->token_registry.expiry_floor) {
+        quic->token_registry.expiry_floor = expiry_time_max;
+    }
 }
 
-
-static void* picoquic_registered_token_value(picosplay_node_t* node)
+static void picoquic_registered_token_free(picoquic_quic_t* quic)
 {
-    return (void*)((node == NULL)?NULL:((char*)node - offsetof(struct st_picoquic_registered_token_t, registered_token_node)));
+    for (int i = 0; i < PICOQUIC_TOKEN_REGISTRY_SHARDS; i++) {
+        if (quic->token_registry.shard[i] != NULL) {
+            free(quic->token_registry.shard[i]);
+            quic->token_registry.shard[i] = NULL;
+        }
+    }
 }
 
-static void picoquic_registered_token_delete(void* tree, picosplay_node_t* node)
-{
-    picoquic_registered_token_t* rt = (picoquic_registered_token_t*)picoquic_registered_token_value(node);
-    free(rt);
-}
+/* Initial packet rate limiting, per source prefix */
 
-int picoquic_registered_token_check_reuse(picoquic_quic_t * quic,
-    const uint8_t * token, size_t token_length, uint64_t expiry_time)
+int picoquic_set_initial_rate_limit(picoquic_quic_t* quic, uint64_t packets_per_second, uint64_t burst)
 {
-    int ret = -1;
-    if (token_length >= 8) {
-        picoquic_registered_token_t* rt = (picoquic_registered_token_t*)malloc(sizeof(picoquic_registered_token_t));
-        if (rt != NULL) {
-            picosplay_node_t* rt_n = NULL;
-            memset(rt, 0, sizeof(picoquic_registered_token_t));
-            rt->token_time = expiry_time;
-            rt->token_hash = PICOPARSE_64(token + token_length - 8);
-            rt->count = 1;
-            rt_n = picosplay_find(&quic->token_reuse_tree, rt);
-            if (rt_n != NULL) {
-                free(rt);
-                rt = (picoquic_registered_token_t*)picoquic_registered_token_value(rt_n);
-                rt->count++;
-                DBG_PRINTF("Token reuse detected, count=%d", rt->count);
-            }
-            else {
-                (void)picosplay_insert(&quic->token_reuse_tree, rt);
-                ret = 0;
+    int ret = 0;
+
+    if (packets_per_second == 0) {
+        if (quic->initial_rate_limiter != NULL) {
+            free(quic->initial_rate_limiter);
+            quic->initial_rate_limiter = NULL;
+        }
+    }
+    else {
+        if (quic->initial_rate_limiter == NULL) {
+            quic->initial_rate_limiter = (picoquic_initial_rate_limiter_t*)malloc(sizeof(picoquic_initial_rate_limiter_t));
+            if (quic->initial_rate_limiter != NULL) {
+                memset(quic->initial_rate_limiter, 0, sizeof(picoquic_initial_rate_limiter_t));
             }
         }
+        if (quic->initial_rate_limiter == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            quic->initial_rate_limiter->packets_per_second = packets_per_second;
+            quic->initial_rate_limiter->burst = (burst == 0) ? 1 : burst;
+        }
     }
 
     return ret;
 }
 
-void picoquic_registered_token_clear(picoquic_quic_t* quic, uint64_t expiry_time_max)
+uint64_t picoquic_get_initial_rate_limited(picoquic_quic_t* quic)
+{
+    return (quic->initial_rate_limiter == NULL) ? 0 : quic->initial_rate_limiter->nb_limited;
+}
+
+/* Returns 0 if the Initial packet can be processed, -1 if the source prefix exceeded its rate */
+int picoquic_initial_rate_check(picoquic_quic_t* quic, const struct sockaddr* addr_from, uint64_t current_time)
 {
-    int end_reached = 0;
-    do {
-        picoquic_registered_token_t* rt_first = (picoquic_registered_token_t*)
-            picoquic_registered_token_value(picosplay_first(&quic->token_reuse_tree));
-        if (rt_first == NULL || rt_first->token_time >= expiry_time_max) {
-            end_reached = 1;
+    int ret = 0;
+    picoquic_initial_rate_limiter_t* limiter = quic->initial_rate_limiter;
+
+    if (limiter != NULL) {
+        uint8_t prefix[9];
+        size_t prefix_length;
+        uint64_t h;
+        picoquic_initial_rate_slot_t* slot;
+        uint64_t credit_max = limiter->burst * 1000000ull;
+
+        if (addr_from->sa_family == AF_INET) {
+            prefix[0] = 4;
+            memcpy(prefix + 1, &((struct sockaddr_in*)addr_from)->sin_addr, 3);
+            prefix_length = 4;
         }
         else {
-            picosplay_delete_hint(&quic->token_reuse_tree, &rt_first->registered_token_node);
+            prefix[0] = 6;
+            memcpy(prefix + 1, &((struct sockaddr_in6*)addr_from)->sin6_addr, 8);
+            prefix_length = 9;
         }
-    } while (!end_reached);
+        h = picohash_siphash(prefix, prefix_length, quic->hash_seed);
+        slot = &limiter->slot[h % PICOQUIC_INITIAL_RATE_SLOTS];
+
+        if (slot->prefix_hash != h || slot->last_time == 0) {
+            /* New prefix in this slot, start with a full bucket */
+            slot->prefix_hash = h;
+            slot->credit = credit_max;
+        }
+        else if (current_time > slot->last_time) {
+            uint64_t delta_t = current_time - slot->last_time;
+
+            if (delta_t >= credit_max / limiter->packets_per_second) {
+                slot->credit = credit_max;
+            }
+            else {
+                slot->credit += delta_t * limiter->packets_per_second;
+                if (slot->credit > credit_max) {
+                    slot->credit = credit_max;
+                }
+            }
+        }
+        slot->last_time = (current_time == 0) ? 1 : current_time;
+
+        if (slot->credit >= 1000000ull) {
+            slot->credit -= 1000000ull;
+        }
+        else {
+            limiter->nb_limited++;
+            ret = -1;
+        }
+    }
+
+    return ret;
 }
 
 int picoquic_adjust_max_connections(picoquic_quic_t * quic, uint32_t max_nb_connections)
@@ -661,15 +801,24 @@ picoquic_quic_t* picoquic_create(uint32_t max_nb_connections,
         quic->local_cnxid_ttl = UINT64_MAX;
         quic->stateless_reset_next_time = current_time;
         quic->stateless_reset_min_interval = PICOQUIC_MICROSEC_STATELESS_RESET_INTERVAL_DEFAULT;
+        quic->stateless_ring_size = PICOQUIC_STATELESS_RING_SIZE_DEFAULT;
+        quic->stateless_full_policy = picoquic_stateless_full_drop_new;
         quic->default_stream_priority = PICOQUIC_DEFAULT_STREAM_PRIORITY;
         quic->default_datagram_priority = PICOQUIC_DEFAULT_STREAM_PRIORITY;
         quic->cwin_max = UINT64_MAX;
         quic->sequence_hole_pseudo_period = PICOQUIC_DEFAULT_HOLE_PERIOD;
+        /* The list of supported versions does not change, it is encoded once
+         * and copied in each version negotiation packet. */
+        for (size_t i = 0; i < picoquic_nb_supported_versions && i < PICOQUIC_NB_SUPPORTED_VERSIONS_MAX; i++) {
+            picoformat_32(quic->vn_version_list + quic->vn_version_list_length, picoquic_supported_versions[i].version);
+            quic->vn_version_list_length += 4;
+        }
 
         picoquic_init_transport_parameters(&quic->default_tp, 0);
 
         quic->random_initial = 1;
         picoquic_wake_list_init(quic);
+        picoquic_object_pools_init(quic);
 
         if (cnx_id_callback != NULL) {
             quic->unconditional_cnx_id = 1;
@@ -691,13 +840,13 @@ picoquic_quic_t* picoquic_create(uint32_t max_nb_connections,
 
 
             if (max_cnx4 < (size_t)max_nb_connections ||
-                (quic->table_cnx_by_id = picohash_create_ex((size_t)max_nb_connections * 4,
+                (quic->table_cnx_by_id = picohash_create_open((size_t)max_nb_connections * 4,
                 picoquic_local_cnxid_hash, picoquic_local_cnxid_compare, picoquic_local_cnxid_to_item, quic->hash_seed)) == NULL ||
-                (quic->table_cnx_by_net = picohash_create_ex((size_t)max_nb_connections * 4,
+                (quic->table_cnx_by_net = picohash_create_open((size_t)max_nb_connections * 4,
                     picoquic_net_id_hash, picoquic_net_id_compare, picoquic_local_netid_to_item, quic->hash_seed)) == NULL ||
-                (quic->table_cnx_by_icid = picohash_create_ex((size_t)max_nb_connections,
+                (quic->table_cnx_by_icid = picohash_create_open((size_t)max_nb_connections,
                     picoquic_net_icid_hash, picoquic_net_icid_compare, picoquic_net_icid_to_item, quic->hash_seed)) == NULL ||
-                (quic->table_cnx_by_secret = picohash_create_ex((size_t)max_nb_connections * 4,
+                (quic->table_cnx_by_secret = picohash_create_open((size_t)max_nb_connections * 4,
                     picoquic_net_secret_hash, picoquic_net_secret_compare, picoquic_net_secret_to_item, quic->hash_seed)) == NULL ||
                 (quic->table_issued_tickets = picohash_create_ex((size_t)max_nb_connections,
                     picoquic_issued_ticket_hash, picoquic_issued_ticket_compare, picoquic_issued_ticket_key_to_item, quic->hash_seed)) == NULL) {
@@ -705,8 +854,6 @@ picoquic_quic_t* picoquic_create(uint32_t max_nb_connections,
                 DBG_PRINTF("%s", "Cannot initialize hash tables\n");
             }
             else {
-                picosplay_init_tree(&quic->token_reuse_tree, picoquic_registered_token_compare,
-                    picoquic_registered_token_create, picoquic_registered_token_delete, picoquic_registered_token_value);
                 if (picoquic_master_tlscontext(quic, cert_file_name, key_file_name, cert_root_file_name, ticket_encryption_key, ticket_encryption_key_length) != 0) {
                     ret = -1;
                     DBG_PRINTF("%s", "Cannot create TLS context \n");
@@ -763,6 +910,134 @@ picoquic_quic_t* picoquic_create(uint32_t max_nb_connections,
     return quic;
 }
 
+picoquic_quic_group_t* picoquic_create_quic_group(int nb_shards, uint32_t max_nb_connections,
+    char const* cert_file_name, char const* key_file_name, char const* cert_root_file_name,
+    char const* default_alpn,
+    picoquic_stream_data_cb_fn default_callback_fn,
+    void* default_callback_ctx,
+    picoquic_connection_id_cb_fn cnx_id_callback,
+    void* cnx_id_callback_ctx,
+    uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE],
+    uint64_t current_time,
+    uint64_t* p_simulated_time,
+    char const* ticket_file_name,
+    const uint8_t* ticket_encryption_key,
+    size_t ticket_encryption_key_length)
+{
+    int ret = 0;
+    uint8_t group_ticket_key[PICOQUIC_GROUP_TICKET_KEY_SIZE];
+    picoquic_quic_group_t* group = NULL;
+
+    if (nb_shards <= 0 ||
+        (group = (picoquic_quic_group_t*)malloc(sizeof(picoquic_quic_group_t))) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(group, 0, sizeof(picoquic_quic_group_t));
+        if ((group->shard = (picoquic_quic_t**)malloc(nb_shards * sizeof(picoquic_quic_t*))) == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(group->shard, 0, nb_shards * sizeof(picoquic_quic_t*));
+            group->nb_shards = nb_shards;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < nb_shards; i++) {
+        group->shard[i] = picoquic_create(max_nb_connections, cert_file_name, key_file_name, cert_root_file_name,
+            default_alpn, default_callback_fn, default_callback_ctx, cnx_id_callback, cnx_id_callback_ctx,
+            reset_seed, current_time, p_simulated_time, (i == 0) ? ticket_file_name : NULL,
+            ticket_encryption_key, ticket_encryption_key_length);
+        if (group->shard[i] == NULL) {
+            DBG_PRINTF("Cannot create the QUIC context of shard %d", i);
+            ret = -1;
+        }
+        else if (i == 0) {
+            /* The first shard provides the secrets shared by the group */
+            if (reset_seed == NULL) {
+                reset_seed = group->shard[0]->reset_seed;
+            }
+            if (ticket_encryption_key == NULL || ticket_encryption_key_length == 0) {
+                picoquic_crypto_random(group->shard[0], group_ticket_key, sizeof(group_ticket_key));
+                ticket_encryption_key = group_ticket_key;
+                ticket_encryption_key_length = sizeof(group_ticket_key);
+                ret = picoquic_set_ticket_encryption_key(group->shard[0], ticket_encryption_key, ticket_encryption_key_length);
+            }
+        }
+    }
+
+    memset(group_ticket_key, 0, sizeof(group_ticket_key));
+
+    if (ret != 0) {
+        picoquic_delete_quic_group(group);
+        group = NULL;
+    }
+
+    return group;
+}
+
+int picoquic_quic_group_size(picoquic_quic_group_t* group)
+{
+    return group->nb_shards;
+}
+
+picoquic_quic_t* picoquic_quic_group_shard(picoquic_quic_group_t* group, int shard_id)
+{
+    return (shard_id >= 0 && shard_id < group->nb_shards) ? group->shard[shard_id] : NULL;
+}
+
+picoquic_quic_t* picoquic_quic_group_release_shard(picoquic_quic_group_t* group, int shard_id)
+{
+    picoquic_quic_t* quic = picoquic_quic_group_shard(group, shard_id);
+
+    if (quic != NULL) {
+        group->shard[shard_id] = NULL;
+    }
+
+    return quic;
+}
+
+void picoquic_delete_quic_group(picoquic_quic_group_t* group)
+{
+    if (group != NULL) {
+        if (group->shard != NULL) {
+            for (int i = 0; i < group->nb_shards; i++) {
+                if (group->shard[i] != NULL) {
+                    picoquic_free(group->shard[i]);
+                }
+            }
+            free(group->shard);
+        }
+        free(group);
+    }
+}
+
+int picoquic_quic_group_set_next_ticket_key(picoquic_quic_group_t* group, uint8_t key_id, const uint8_t* key, size_t key_length)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < group->nb_shards; i++) {
+        if (group->shard[i] != NULL) {
+            ret = picoquic_set_next_ticket_key(group->shard[i], key_id, key, key_length);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_quic_group_rotate_ticket_keys(picoquic_quic_group_t* group, uint8_t key_id)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < group->nb_shards; i++) {
+        if (group->shard[i] != NULL) {
+            ret = picoquic_rotate_ticket_keys(group->shard[i], key_id);
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_load_token_file(picoquic_quic_t* quic, char const * token_file_name)
 {
     int ret = picoquic_load_tokens(quic, token_file_name);
@@ -840,6 +1115,23 @@ void picoquic_set_default_lossbit_policy(picoquic_quic_t* quic, picoquic_lossbit
     quic->default_tp.enable_loss_bit = (int)default_lossbit_policy;
 }
 
+int picoquic_set_siphash13(picoquic_quic_t* quic, int use_siphash13)
+{
+    int ret = 0;
+
+    if (quic->table_cnx_by_net->count > 0 || quic->table_cnx_by_icid->count > 0 ||
+        quic->table_cnx_by_secret->count > 0) {
+        /* Existing entries were hashed with the other function */
+        ret = -1;
+    }
+    else {
+        quic->table_cnx_by_net->picohash_hash = (use_siphash13) ? picoquic_net_id_hash13 : picoquic_net_id_hash;
+        quic->table_cnx_by_icid->picohash_hash = (use_siphash13) ? picoquic_net_icid_hash13 : picoquic_net_icid_hash;
+        quic->table_cnx_by_secret->picohash_hash = (use_siphash13) ? picoquic_net_secret_hash13 : picoquic_net_secret_hash;
+    }
+    return ret;
+}
+
 void picoquic_set_default_multipath_option(picoquic_quic_t* quic, int multipath_option)
 {
     quic->default_multipath_option = multipath_option;
@@ -886,6 +1178,16 @@ void picoquic_set_max_data_control(picoquic_quic_t* quic, uint64_t max_data)
     }
 }
 
+void picoquic_set_receive_window_autotuning(picoquic_quic_t* quic, uint64_t max_window)
+{
+    quic->rcv_window_max = max_window;
+}
+
+void picoquic_set_max_streams_autotuning(picoquic_quic_t* quic, uint64_t max_increment)
+{
+    quic->max_streams_increment_max = max_increment;
+}
+
 void picoquic_set_default_idle_timeout(picoquic_quic_t* quic, uint64_t idle_timeout_ms)
 {
     quic->default_tp.max_idle_timeout = idle_timeout_ms;
@@ -956,6 +1258,13 @@ void picoquic_free(picoquic_quic_t* quic)
             picoquic_delete_cnx(quic->cnx_list);
         }
 
+        if (quic->cnx_wake_wheel != NULL) {
+            picowheel_delete(quic->cnx_wake_wheel);
+            quic->cnx_wake_wheel = NULL;
+        }
+
+        picoquic_object_pools_release(quic);
+
         /* Delete ECH context if it was created */
         picoquic_release_quic_ech_ctx(quic);
 
@@ -979,37 +1288,124 @@ void picoquic_free(picoquic_quic_t* quic)
 
         /* delete the stored tickets */
         picoquic_free_tickets(&quic->p_first_ticket);
+        picoquic_free_ticket_index(quic);
 
         /* Delete the stored tokens */
         picoquic_free_tokens(&quic->p_first_token);
+        picoquic_free_token_index(quic);
+
+        /* Delete the careful resume cache */
+        picoquic_careful_resume_free(quic);
+
+        /* Delete the transport parameter cache */
+        picoquic_tp_cache_free(quic);
 
-        /* Deelete the reused tokens tree */
-        picosplay_empty_tree(&quic->token_reuse_tree);
+        /* Delete the Initial key cache */
+        picoquic_initial_key_cache_free(quic);
+
+        /* Delete the congestion manager groups */
+        picoquic_cc_manager_free(quic);
+
+        /* Delete the PMTU cache */
+        picoquic_pmtu_cache_free(quic);
+
+        /* Delete or unmap the anti-replay filter */
+        picoquic_anti_replay_free(quic);
+        picoquic_ticket_key_ring_free(quic);
+
+        /* Delete the certificate verification cache */
+        picoquic_cert_cache_free(quic);
+
+        /* Delete the metrics */
+        picoquic_disable_quic_metrics(quic);
+
+        /* Unmap the shared store, if any */
+        picoquic_detach_shared_ticket_store(quic);
+
+        /* Delete the token reuse registry and the rate limiter */
+        picoquic_registered_token_free(quic);
+        if (quic->initial_rate_limiter != NULL) {
+            free(quic->initial_rate_limiter);
+            quic->initial_rate_limiter = NULL;
+        }
+        picoquic_admission_free(quic);
+        picoquic_tombstone_free(quic);
+        picoquic_egress_free(quic);
 
         /* delete packets in pool */
         while (quic->p_first_packet != NULL) {
             picoquic_packet_t * p = quic->p_first_packet->packet_previous;
-            free(quic->p_first_packet);
+            if (!picoquic_is_prewarmed(quic, quic->p_first_packet)) {
+                free(quic->p_first_packet);
+            }
             quic->p_first_packet = p;
             quic->nb_packets_allocated--;
             quic->nb_packets_in_pool--;
         }
 
+        while (quic->p_first_small_packet != NULL) {
+            picoquic_packet_t* p = quic->p_first_small_packet->packet_previous;
+            if (!picoquic_is_prewarmed(quic, quic->p_first_small_packet)) {
+                free(quic->p_first_small_packet);
+            }
+            quic->p_first_small_packet = p;
+            quic->nb_packets_allocated--;
+            quic->nb_packets_in_pool--;
+        }
+
+        while (quic->p_first_jumbo_packet != NULL) {
+            picoquic_packet_t* p = quic->p_first_jumbo_packet->packet_previous;
+            free(quic->p_first_jumbo_packet);
+            quic->p_first_jumbo_packet = p;
+            quic->nb_packets_allocated--;
+            quic->nb_packets_in_pool--;
+        }
+
         /* delete data nodes in pool */
         while (quic->p_first_data_node != NULL) {
             picoquic_stream_data_node_t* p = quic->p_first_data_node->next_stream_data;
-            free(quic->p_first_data_node);
+            if (!picoquic_is_prewarmed(quic, quic->p_first_data_node)) {
+                free(quic->p_first_data_node);
+            }
             quic->p_first_data_node = p;
             quic->nb_data_nodes_allocated--;
             quic->nb_data_nodes_in_pool--;
         }
 
+        while (quic->p_first_small_data_node != NULL) {
+            picoquic_stream_data_node_t* p = quic->p_first_small_data_node->next_stream_data;
+            if (!picoquic_is_prewarmed(quic, quic->p_first_small_data_node)) {
+                free(quic->p_first_small_data_node);
+            }
+            quic->p_first_small_data_node = p;
+            quic->nb_data_nodes_allocated--;
+            quic->nb_data_nodes_in_pool--;
+        }
+
+        while (quic->p_first_jumbo_data_node != NULL) {
+            picoquic_stream_data_node_t* p = quic->p_first_jumbo_data_node->next_stream_data;
+            free(quic->p_first_jumbo_data_node);
+            quic->p_first_jumbo_data_node = p;
+            quic->nb_data_nodes_allocated--;
+            quic->nb_data_nodes_in_pool--;
+        }
+
+        picoquic_prewarm_slabs_release(quic);
+
         /* delete all pending stateless packets */
         while (quic->pending_stateless_packet != NULL) {
             picoquic_stateless_packet_t* to_delete = quic->pending_stateless_packet;
             quic->pending_stateless_packet = to_delete->next_packet;
             free(to_delete);
         }
+        if (quic->stateless_ring != NULL) {
+            free(quic->stateless_ring);
+            quic->stateless_ring = NULL;
+        }
+        if (quic->hp_mask_batch != NULL) {
+            free(quic->hp_mask_batch);
+            quic->hp_mask_batch = NULL;
+        }
 
         if (quic->table_cnx_by_id != NULL) {
             picohash_delete(quic->table_cnx_by_id, 0);
@@ -1030,6 +1426,7 @@ void picoquic_free(picoquic_quic_t* quic)
         if (quic->table_cnx_by_secret != NULL) {
             picohash_delete(quic->table_cnx_by_secret, 0);
         }
+        picoquic_reset_filter_release(quic);
 
         if (quic->verify_certificate_callback != NULL) {
             picoquic_dispose_verify_certificate_callback(quic);
@@ -1053,6 +1450,12 @@ void picoquic_free(picoquic_quic_t* quic)
             (void)(quic->perflog_fn)(quic, NULL, 1);
         }
 
+        if (quic->memlog_call_back != NULL) {
+            quic->memlog_call_back(NULL, NULL, quic->memlog_ctx, 1, 0);
+        }
+
+        picoquic_buffered_random_clear(quic);
+
         free(quic);
     }
 }
@@ -1095,38 +1498,141 @@ uint32_t picoquic_get_max_half_open_retry_threshold(picoquic_quic_t* quic)
     return quic->max_half_open_before_retry;
 }
 
-picoquic_stateless_packet_t* picoquic_create_stateless_packet(picoquic_quic_t* quic)
+int picoquic_set_stateless_queue(picoquic_quic_t* quic, size_t nb_slots, picoquic_stateless_full_policy_enum full_policy)
 {
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(quic);
-#endif
-    return (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
+    int ret = 0;
+
+    if (picoquic_has_pending_stateless_packet(quic)) {
+        ret = -1;
+    }
+    else {
+        if (quic->stateless_ring != NULL) {
+            free(quic->stateless_ring);
+            quic->stateless_ring = NULL;
+        }
+        quic->stateless_ring_size = nb_slots;
+        quic->stateless_ring_head = 0;
+        quic->stateless_full_policy = full_policy;
+    }
+
+    return ret;
 }
 
-void picoquic_delete_stateless_packet(picoquic_stateless_packet_t* sp)
+uint64_t picoquic_get_nb_stateless_packets_dropped(picoquic_quic_t* quic)
 {
-    free(sp);
+    return quic->nb_stateless_packets_dropped;
 }
 
-void picoquic_queue_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp)
+static int picoquic_is_stateless_ring_slot(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp)
 {
-    picoquic_stateless_packet_t** pnext = &quic->pending_stateless_packet;
+    return (quic->stateless_ring != NULL && sp >= quic->stateless_ring &&
+        sp < quic->stateless_ring + quic->stateless_ring_size);
+}
 
-    while ((*pnext) != NULL) {
-        pnext = &(*pnext)->next_packet;
+int picoquic_has_pending_stateless_packet(picoquic_quic_t* quic)
+{
+    return (quic->stateless_ring_count > 0 || quic->pending_stateless_packet != NULL);
+}
+
+picoquic_stateless_packet_t* picoquic_create_stateless_packet(picoquic_quic_t* quic)
+{
+    picoquic_stateless_packet_t* sp = NULL;
+    int use_ring = 0;
+
+    if (quic->stateless_ring == NULL && quic->stateless_ring_size > 0) {
+        quic->stateless_ring = (picoquic_stateless_packet_t*)malloc(
+            quic->stateless_ring_size * sizeof(picoquic_stateless_packet_t));
+        quic->stateless_ring_head = 0;
+        quic->stateless_ring_count = 0;
+    }
+
+    if (quic->stateless_ring == NULL) {
+        sp = (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
+    }
+    else if (quic->stateless_ring_count < quic->stateless_ring_size) {
+        use_ring = 1;
+    }
+    else {
+        switch (quic->stateless_full_policy) {
+        case picoquic_stateless_full_drop_oldest:
+            quic->stateless_ring_head = (quic->stateless_ring_head + 1) % quic->stateless_ring_size;
+            quic->stateless_ring_count--;
+            quic->nb_stateless_packets_dropped++;
+            use_ring = 1;
+            break;
+        case picoquic_stateless_full_allocate:
+            sp = (picoquic_stateless_packet_t*)malloc(sizeof(picoquic_stateless_packet_t));
+            break;
+        default:
+            quic->nb_stateless_packets_dropped++;
+            break;
+        }
+    }
+
+    if (use_ring) {
+        /* The slot after the last queued packet is reserved, until the packet is queued. */
+        sp = &quic->stateless_ring[(quic->stateless_ring_head + quic->stateless_ring_count) % quic->stateless_ring_size];
+    }
+
+    if (sp != NULL) {
+        sp->next_packet = NULL;
+    }
+
+    return sp;
+}
+
+void picoquic_delete_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp)
+{
+    if (picoquic_is_stateless_ring_slot(quic, sp)) {
+        /* Release the slot if this is the dequeued packet. A slot that was
+         * reserved but not queued is simply reused. */
+        if (quic->stateless_ring_count > 0 && sp == &quic->stateless_ring[quic->stateless_ring_head]) {
+            quic->stateless_ring_head = (quic->stateless_ring_head + 1) % quic->stateless_ring_size;
+            quic->stateless_ring_count--;
+        }
+    }
+    else {
+        free(sp);
+    }
+}
+
+void picoquic_queue_stateless_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp)
+{
+    if (picoquic_is_stateless_ring_slot(quic, sp)) {
+        if (quic->stateless_ring_count < quic->stateless_ring_size &&
+            sp == &quic->stateless_ring[(quic->stateless_ring_head + quic->stateless_ring_count) % quic->stateless_ring_size]) {
+            quic->stateless_ring_count++;
+        }
+        else {
+            DBG_PRINTF("%s", "Stateless packet queued out of its reserved slot");
+        }
     }
+    else {
+        picoquic_stateless_packet_t** pnext = &quic->pending_stateless_packet;
 
-    *pnext = sp;
-    sp->next_packet = NULL;
+        while ((*pnext) != NULL) {
+            pnext = &(*pnext)->next_packet;
+        }
+
+        *pnext = sp;
+        sp->next_packet = NULL;
+    }
 }
 
 picoquic_stateless_packet_t* picoquic_dequeue_stateless_packet(picoquic_quic_t* quic)
 {
-    picoquic_stateless_packet_t* sp = quic->pending_stateless_packet;
+    picoquic_stateless_packet_t* sp = NULL;
 
-    if (sp != NULL) {
+    if (quic->stateless_ring_count > 0) {
+        /* The slot stays in use until the packet is deleted */
+        sp = &quic->stateless_ring[quic->stateless_ring_head];
+    }
+    else if ((sp = quic->pending_stateless_packet) != NULL) {
         quic->pending_stateless_packet = sp->next_packet;
         sp->next_packet = NULL;
+    }
+
+    if (sp != NULL) {
         picoquic_log_quic_pdu(quic, 0, picoquic_get_quic_time(quic), sp->cnxid_log64,
             (struct sockaddr*) & sp->addr_to, (struct sockaddr*) & sp->addr_local, sp->length);
     }
@@ -1248,6 +1754,7 @@ void picoquic_unregister_net_secret(picoquic_cnx_t* cnx)
 {
     if (cnx->registered_secret_addr.ss_family != 0) {
         picohash_delete_key(cnx->quic->table_cnx_by_secret, cnx, 0);
+        picoquic_reset_filter_remove(cnx->quic, cnx->registered_reset_secret);
         memset(&cnx->registered_secret_addr, 0, sizeof(struct sockaddr_storage));
         memset(&cnx->registered_reset_secret, 0, sizeof(PICOQUIC_RESET_SECRET_SIZE));
     }
@@ -1270,6 +1777,9 @@ int picoquic_register_net_secret(picoquic_cnx_t* cnx)
         else {
             ret = picohash_insert(cnx->quic->table_cnx_by_secret, cnx);
         }
+        /* The filter entries mirror registered_secret_addr, so that
+         * picoquic_unregister_net_secret removes exactly what was added. */
+        picoquic_reset_filter_add(cnx->quic, cnx->registered_reset_secret);
     }
     return ret;
 }
@@ -1293,6 +1803,7 @@ void picoquic_init_transport_parameters(picoquic_tp_t* tp, int client_mode)
     tp->min_ack_delay = PICOQUIC_ACK_DELAY_MIN;
     tp->enable_time_stamp = 0;
     tp->enable_bdp_frame = 0;
+    tp->enable_fec = 0;
 }
 
 
@@ -1325,6 +1836,9 @@ static void picoquic_insert_cnx_in_list(picoquic_quic_t* quic, picoquic_cnx_t* c
     quic->cnx_list = cnx;
     cnx->previous_in_table = NULL;
     quic->current_number_connections++;
+    if (quic->metrics != NULL) {
+        quic->metrics->live.nb_connections_created++;
+    }
 }
 
 static void picoquic_remove_cnx_from_list(picoquic_cnx_t* cnx)
@@ -1346,6 +1860,9 @@ static void picoquic_remove_cnx_from_list(picoquic_cnx_t* cnx)
     picoquic_unregister_net_secret(cnx);
 
     cnx->quic->current_number_connections--;
+    if (cnx->quic->metrics != NULL) {
+        cnx->quic->metrics->live.nb_connections_deleted++;
+    }
 }
 
 /* Management of the list of connections, sorted by wake time */
@@ -1382,14 +1899,33 @@ static void picoquic_wake_list_init(picoquic_quic_t * quic)
         picoquic_wake_list_create_node, picoquic_wake_list_delete_node, picoquic_wake_list_node_value);
 }
 
-static void picoquic_remove_cnx_from_wake_list(picoquic_cnx_t* cnx)
+static picoquic_cnx_t* picoquic_wake_wheel_node_value(picowheel_node_t* cnx_wheel_node)
+{
+    return (cnx_wheel_node == NULL) ? NULL : (picoquic_cnx_t*)((char*)cnx_wheel_node - offsetof(struct st_picoquic_cnx_t, cnx_wheel_node));
+}
+
+void picoquic_remove_cnx_from_wake_list(picoquic_cnx_t* cnx)
 {
-    picosplay_delete_hint(&cnx->quic->cnx_wake_tree, &cnx->cnx_wake_node);
+    if (cnx->is_egress_queued) {
+        /* Ready connections wait in their egress group, not in the wake list */
+        picoquic_egress_unqueue(cnx);
+    }
+    else if (cnx->quic->cnx_wake_wheel != NULL) {
+        picowheel_remove(cnx->quic->cnx_wake_wheel, &cnx->cnx_wheel_node);
+    }
+    else {
+        picosplay_delete_hint(&cnx->quic->cnx_wake_tree, &cnx->cnx_wake_node);
+    }
 }
 
 static void picoquic_insert_cnx_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx)
 {
-    picosplay_insert(&quic->cnx_wake_tree, cnx);
+    if (quic->cnx_wake_wheel != NULL) {
+        picowheel_insert(quic->cnx_wake_wheel, &cnx->cnx_wheel_node, cnx->next_wake_time);
+    }
+    else {
+        picosplay_insert(&quic->cnx_wake_tree, cnx);
+    }
 }
 
 void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx, uint64_t next_time)
@@ -1399,9 +1935,22 @@ void picoquic_reinsert_by_wake_time(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
     picoquic_insert_cnx_by_wake_time(quic, cnx);
 }
 
+static picoquic_cnx_t* picoquic_wake_list_first(picoquic_quic_t* quic)
+{
+    if (quic->cnx_wake_wheel != NULL) {
+        return picoquic_wake_wheel_node_value(picowheel_first(quic->cnx_wake_wheel));
+    }
+    return (picoquic_cnx_t*)picoquic_wake_list_node_value(picosplay_first(&quic->cnx_wake_tree));
+}
+
 picoquic_cnx_t* picoquic_get_earliest_cnx_to_wake(picoquic_quic_t* quic, uint64_t max_wake_time)
 {
-    picoquic_cnx_t* cnx = (picoquic_cnx_t *)picoquic_wake_list_node_value(picosplay_first(&quic->cnx_wake_tree));
+    picoquic_cnx_t* cnx;
+
+    if (quic->cnx_wake_wheel != NULL && max_wake_time != 0) {
+        picowheel_advance(quic->cnx_wake_wheel, max_wake_time);
+    }
+    cnx = picoquic_wake_list_first(quic);
     if (cnx != NULL && max_wake_time != 0 && cnx->next_wake_time > max_wake_time)
     {
         cnx = NULL;
@@ -1414,21 +1963,124 @@ uint64_t picoquic_get_next_wake_time(picoquic_quic_t* quic, uint64_t current_tim
 {
     uint64_t wake_time = UINT64_MAX;
 
-    if (quic->pending_stateless_packet != NULL) {
+    if (picoquic_has_pending_stateless_packet(quic)) {
         wake_time = current_time;
     }
     else{
-        picoquic_cnx_t* cnx_wake_first = (picoquic_cnx_t*)picoquic_wake_list_node_value(
-            picosplay_first(&quic->cnx_wake_tree));
+        picoquic_cnx_t* cnx_wake_first;
+
+        if (quic->cnx_wake_wheel != NULL) {
+            picowheel_advance(quic->cnx_wake_wheel, current_time);
+        }
+        cnx_wake_first = picoquic_wake_list_first(quic);
 
         if (cnx_wake_first != NULL) {
             wake_time = cnx_wake_first->next_wake_time;
         }
+        if (quic->admission != NULL && quic->admission->nb_queued > 0) {
+            uint64_t admission_time = picoquic_admission_next_time(quic, current_time);
+            if (admission_time < wake_time) {
+                wake_time = admission_time;
+            }
+        }
+        if (quic->egress != NULL) {
+            uint64_t egress_time = picoquic_egress_next_time(quic, current_time);
+            if (egress_time < wake_time) {
+                wake_time = egress_time;
+            }
+        }
+    }
+
+    return wake_time;
+}
+
+void picoquic_set_timer_slack(picoquic_quic_t* quic, uint64_t timer_slack)
+{
+    quic->timer_slack = timer_slack;
+}
+
+uint64_t picoquic_align_wake_time(picoquic_quic_t* quic, uint64_t wake_time, uint64_t current_time,
+    uint64_t loss_deadline)
+{
+    uint64_t slack = quic->timer_slack;
+
+    if (slack > 0 && wake_time != UINT64_MAX && wake_time >= current_time + slack &&
+        wake_time % slack != 0 && wake_time < UINT64_MAX - slack) {
+        /* Only postpone, so the connection never wakes before its timer */
+        uint64_t aligned_time = wake_time + slack - (wake_time % slack);
+
+        if (loss_deadline < aligned_time) {
+            /* Loss detection and PTO deadlines are not postponed */
+            aligned_time = (loss_deadline > wake_time) ? loss_deadline : wake_time;
+        }
+        wake_time = aligned_time;
     }
 
     return wake_time;
 }
 
+void picoquic_record_loop_wakeup(picoquic_quic_t* quic, uint64_t current_time)
+{
+    quic->nb_wakeups++;
+    if (current_time >= quic->wakeup_window_start + 1000000ull) {
+        if (quic->wakeup_window_start != 0) {
+            quic->wakeups_per_second = (quic->wakeup_window_count * 1000000ull) /
+                (current_time - quic->wakeup_window_start);
+        }
+        quic->wakeup_window_start = current_time;
+        quic->wakeup_window_count = 0;
+    }
+    quic->wakeup_window_count++;
+}
+
+void picoquic_get_wakeup_stats(picoquic_quic_t* quic, uint64_t* nb_wakeups, uint64_t* wakeups_per_second)
+{
+    *nb_wakeups = quic->nb_wakeups;
+    *wakeups_per_second = quic->wakeups_per_second;
+}
+
+int picoquic_set_timer_wheel(picoquic_quic_t* quic, int use_timer_wheel)
+{
+    int ret = 0;
+
+    if (use_timer_wheel && quic->cnx_wake_wheel == NULL) {
+        picowheel_t* wheel = picowheel_new(picoquic_get_quic_time(quic));
+
+        if (wheel == NULL) {
+            DBG_PRINTF("%s", "Cannot allocate the timer wheel.\n");
+            ret = -1;
+        }
+        else {
+            picoquic_cnx_t* cnx = quic->cnx_list;
+
+            while (cnx != NULL) {
+                /* Connections in egress queues are in neither structure */
+                if (!cnx->is_egress_queued) {
+                    picosplay_delete_hint(&quic->cnx_wake_tree, &cnx->cnx_wake_node);
+                    picowheel_insert(wheel, &cnx->cnx_wheel_node, cnx->next_wake_time);
+                }
+                cnx = cnx->next_in_table;
+            }
+            quic->cnx_wake_wheel = wheel;
+        }
+    }
+    else if (!use_timer_wheel && quic->cnx_wake_wheel != NULL) {
+        picoquic_cnx_t* cnx = quic->cnx_list;
+
+        while (cnx != NULL) {
+            if (!cnx->is_egress_queued) {
+                picowheel_remove(quic->cnx_wake_wheel, &cnx->cnx_wheel_node);
+                picosplay_insert(&quic->cnx_wake_tree, cnx);
+            }
+            cnx = cnx->next_in_table;
+        }
+        picowheel_delete(quic->cnx_wake_wheel);
+        quic->cnx_wake_wheel = NULL;
+    }
+
+    return ret;
+}
+
 int64_t picoquic_get_next_wake_delay(picoquic_quic_t* quic,
     uint64_t current_time, int64_t delay_max)
 {
@@ -1459,7 +2111,7 @@ static uint64_t picoquic_get_wake_time(picoquic_cnx_t* cnx, uint64_t current_tim
 {
     uint64_t wake_time = UINT64_MAX;
 
-    if (cnx->quic->pending_stateless_packet != NULL) {
+    if (picoquic_has_pending_stateless_packet(cnx->quic)) {
         wake_time = current_time;
     } else {
         wake_time = cnx->next_wake_time;
@@ -1508,7 +2160,7 @@ int picoquic_get_version_index(uint32_t proposed_version)
 static void picoquic_create_random_cnx_id(picoquic_quic_t* quic, picoquic_connection_id_t * cnx_id, uint8_t id_length)
 {
     if (id_length > 0) {
-        picoquic_crypto_random(quic, cnx_id->id, id_length);
+        picoquic_buffered_random(quic, cnx_id->id, id_length);
     }
     if (id_length < sizeof(cnx_id->id)) {
         memset(cnx_id->id + id_length, 0, sizeof(cnx_id->id) - id_length);
@@ -1577,9 +2229,8 @@ picoquic_packet_t* picoquic_get_last_packet(picoquic_cnx_t* cnx, picoquic_path_t
  */
 picoquic_tuple_t* picoquic_create_tuple(picoquic_path_t* path_x, const struct sockaddr* local_addr, const struct sockaddr* peer_addr, int if_index)
 {
-    picoquic_tuple_t* tuple = (picoquic_tuple_t*)malloc(sizeof(picoquic_tuple_t));
+    picoquic_tuple_t* tuple = (picoquic_tuple_t*)picoquic_object_alloc(path_x->cnx->quic, picoquic_object_tuple);
     if (tuple != NULL) {
-        memset(tuple, 0, sizeof(picoquic_tuple_t));
         /* Add the tuple to the path */
         if (path_x->first_tuple == 0) {
             path_x->first_tuple = tuple;
@@ -1617,7 +2268,116 @@ void picoquic_delete_tuple(picoquic_path_t* path_x, picoquic_tuple_t* tuple)
             }
         }
     }
-    free(tuple);
+    picoquic_object_free(path_x->cnx->quic, picoquic_object_tuple, tuple);
+}
+
+/*
+ * Index of paths by unique path ID.
+ *
+ * Most connections have one or two paths, and a linear search of the path
+ * table is just as fast as anything else. The radix index is only built when
+ * the number of paths exceeds PICOQUIC_PATH_INDEX_THRESHOLD, and it is dropped
+ * when the number of paths falls back to that value. The unique path IDs
+ * grow monotonically, so they fit well in the sliding window of the radix
+ * array. If a path cannot be indexed, for example because its ID is far
+ * from the window, the index is dropped and the searches revert to the
+ * linear scan.
+ */
+static void picoquic_rebuild_path_index(picoquic_cnx_t* cnx)
+{
+    picoradix_clear(&cnx->path_index);
+
+    if (cnx->nb_paths > PICOQUIC_PATH_INDEX_THRESHOLD) {
+        for (int i = 0; i < cnx->nb_paths; i++) {
+            if (picoradix_set(&cnx->path_index, cnx->path[i]->unique_path_id, cnx->path[i]) != 0) {
+                picoradix_clear(&cnx->path_index);
+                break;
+            }
+        }
+    }
+}
+
+static void picoquic_index_path(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    if (cnx->path_index.nb_items > 0) {
+        if (picoradix_set(&cnx->path_index, path_x->unique_path_id, path_x) != 0) {
+            picoradix_clear(&cnx->path_index);
+        }
+    }
+    else if (cnx->nb_paths > PICOQUIC_PATH_INDEX_THRESHOLD) {
+        picoquic_rebuild_path_index(cnx);
+    }
+}
+
+static void picoquic_unindex_path(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    if (cnx->path_index.nb_items > 0) {
+        if (cnx->nb_paths <= PICOQUIC_PATH_INDEX_THRESHOLD + 1) {
+            picoradix_clear(&cnx->path_index);
+        }
+        else {
+            (void)picoradix_remove(&cnx->path_index, path_x->unique_path_id);
+        }
+    }
+}
+
+static void picoquic_swap_paths(picoquic_cnx_t* cnx, int path_index_1, int path_index_2)
+{
+    picoquic_path_t* path_x = cnx->path[path_index_1];
+
+    cnx->path[path_index_1] = cnx->path[path_index_2];
+    cnx->path[path_index_1]->cnx_path_index = path_index_1;
+    cnx->path[path_index_2] = path_x;
+    path_x->cnx_path_index = path_index_2;
+}
+
+int picoquic_get_max_simultaneous_paths(picoquic_quic_t* quic)
+{
+    return (quic->tuning.max_simultaneous_paths > 0) ? quic->tuning.max_simultaneous_paths : PICOQUIC_NB_PATH_TARGET;
+}
+
+void picoquic_set_max_simultaneous_paths(picoquic_quic_t* quic, int max_paths)
+{
+    if (max_paths > PICOQUIC_NB_PATH_MAX) {
+        max_paths = PICOQUIC_NB_PATH_MAX;
+    }
+    quic->tuning.max_simultaneous_paths = (max_paths > 0) ? max_paths : 0;
+}
+
+size_t picoquic_get_packet_loop_recv_max(picoquic_quic_t* quic)
+{
+    return (quic->tuning.packet_loop_recv_max > 0) ? quic->tuning.packet_loop_recv_max : PICOQUIC_PACKET_LOOP_RECV_MAX;
+}
+
+size_t picoquic_get_packet_loop_send_max(picoquic_quic_t* quic)
+{
+    return (quic->tuning.packet_loop_send_max > 0) ? quic->tuning.packet_loop_send_max : PICOQUIC_PACKET_LOOP_SEND_MAX;
+}
+
+void picoquic_get_tuning(picoquic_quic_t* quic, picoquic_tuning_t* tuning)
+{
+    *tuning = quic->tuning;
+    tuning->packet_loop_recv_max = picoquic_get_packet_loop_recv_max(quic);
+    tuning->packet_loop_send_max = picoquic_get_packet_loop_send_max(quic);
+    tuning->max_simultaneous_paths = picoquic_get_max_simultaneous_paths(quic);
+}
+
+void picoquic_set_tuning(picoquic_quic_t* quic, const picoquic_tuning_t* tuning)
+{
+    quic->tuning.max_packets_in_pool = (tuning->max_packets_in_pool > 0) ?
+        tuning->max_packets_in_pool : PICOQUIC_MAX_PACKETS_IN_POOL;
+    quic->tuning.max_data_nodes_in_pool = (tuning->max_data_nodes_in_pool > 0) ?
+        tuning->max_data_nodes_in_pool : PICOQUIC_MAX_PACKETS_IN_POOL;
+    quic->tuning.packet_loop_recv_max = (tuning->packet_loop_recv_max > PICOQUIC_PACKET_LOOP_BATCH_MAX) ?
+        PICOQUIC_PACKET_LOOP_BATCH_MAX : tuning->packet_loop_recv_max;
+    quic->tuning.packet_loop_send_max = (tuning->packet_loop_send_max > PICOQUIC_PACKET_LOOP_BATCH_MAX) ?
+        PICOQUIC_PACKET_LOOP_BATCH_MAX : tuning->packet_loop_send_max;
+    picoquic_set_max_simultaneous_paths(quic, tuning->max_simultaneous_paths);
+}
+
+void picoquic_set_in_place_decryption(picoquic_quic_t* quic, int is_enabled)
+{
+    quic->is_in_place_decryption_enabled = (is_enabled) ? 1 : 0;
 }
 
 /* Path management -- returns the index of the path that was created. */
@@ -1651,11 +2411,10 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, const struct
     {
         uint64_t unique_path_id = picoquic_find_avalaible_unique_path_id(cnx, requested_id);
         picoquic_path_t* path_x = (unique_path_id == UINT64_MAX) ? NULL :
-            (picoquic_path_t*)malloc(sizeof(picoquic_path_t));
+            (picoquic_path_t*)picoquic_object_alloc(cnx->quic, picoquic_object_path);
 
         if (path_x != NULL)
         {
-            memset(path_x, 0, sizeof(picoquic_path_t));
             /* Register the sequence number */
             path_x->unique_path_id = unique_path_id;
             path_x->cnx = cnx;
@@ -1669,6 +2428,8 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, const struct
                 path_x->rtt_variant = 0;
                 path_x->retransmit_timer = PICOQUIC_INITIAL_RETRANSMIT_TIMER;
                 path_x->rtt_min = 0;
+                path_x->reorder_packet_threshold = PICOQUIC_REORDER_PACKET_THRESHOLD;
+                path_x->reorder_window_mult = 1;
 
                 /* Initialize per path congestion control state */
                 path_x->cwin = PICOQUIC_CWIN_INITIAL;
@@ -1677,14 +2438,18 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, const struct
 
                 /* Initialize per path pacing state */
                 picoquic_pacing_init(&path_x->pacing, start_time);
+                picoquic_set_pacing_data_horizon(&path_x->pacing, cnx->quic->pacing_horizon_microsec);
 
                 /* Initialize the MTU */
                 path_x->send_mtu = (peer_addr == NULL || peer_addr->sa_family == AF_INET) ? PICOQUIC_INITIAL_MTU_IPV4 : PICOQUIC_INITIAL_MTU_IPV6;
+                path_x->send_mtu_cached = picoquic_pmtu_cache_get(cnx->quic, peer_addr, start_time);
 
                 /* initialize the quality reporting thresholds */
                 path_x->rtt_update_delta = cnx->rtt_update_delta;
                 path_x->pacing_rate_update_delta = cnx->pacing_rate_update_delta;
                 picoquic_refresh_path_quality_thresholds(path_x);
+                picoquic_cc_telemetry_attach(cnx, path_x);
+                picoquic_cc_manager_join(cnx, path_x, start_time);
 
                 /* In case of unique path_id multipath, initialize the context. We do that systematically,
                  * because path 0 is created before multipath options are negotiated.
@@ -1693,7 +2458,9 @@ int picoquic_create_path(picoquic_cnx_t* cnx, uint64_t start_time, const struct
                 picoquic_init_packet_ctx(cnx, &path_x->pkt_ctx, picoquic_packet_context_application);
                 /* Record the path */
                 cnx->path[cnx->nb_paths] = path_x;
+                path_x->cnx_path_index = cnx->nb_paths;
                 ret = cnx->nb_paths++;
+                picoquic_index_path(cnx, path_x);
 
                 /* Set the challenge used for this path */
                 picoquic_set_path_challenge(cnx, cnx->nb_paths - 1, start_time);
@@ -1724,17 +2491,34 @@ void picoquic_register_path(picoquic_cnx_t* cnx, picoquic_path_t * path_x)
 static void picoquic_clear_path_data(picoquic_cnx_t* cnx, picoquic_path_t * path_x) 
 {
     picoquic_unregister_net_id(cnx, path_x);
+    picoquic_cc_manager_leave(path_x);
     /* Remove the congestion data */
     if (cnx->congestion_alg != NULL) {
         cnx->congestion_alg->alg_delete(path_x);
     }
+    /* Close the telemetry ring. Readers may still hold it. */
+    picoquic_cc_telemetry_detach(path_x);
     /* Remove the list of tuples */
     while (path_x->first_tuple != NULL) {
         picoquic_delete_tuple(path_x, path_x->first_tuple);
     }
 
     /* Free the record */
-    free(path_x);
+    picoquic_object_free(cnx->quic, picoquic_object_path, path_x);
+}
+
+/* The deadline of the last loss check assumes that the oldest packet of
+ * each context stays on the same path. When a path is deleted or demoted,
+ * the packets sent on it must be evaluated again at the next opportunity.
+ */
+void picoquic_reset_loss_check(picoquic_cnx_t* cnx)
+{
+    for (int pc = 0; pc < picoquic_nb_packet_context; pc++) {
+        cnx->pkt_ctx[pc].loss_check_time = 0;
+    }
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        cnx->path[i]->pkt_ctx.loss_check_time = 0;
+    }
 }
 
 void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index)
@@ -1743,6 +2527,9 @@ void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index)
     picoquic_packet_t* p = NULL;
     picoquic_stream_head_t* stream = NULL;
 
+    /* ACK data pending in the receive batch may refer to the path */
+    picoquic_ack_batch_flush(cnx);
+
     picoquic_reset_packet_context(cnx, &path_x->pkt_ctx);
     picoquic_reset_ack_context(&path_x->ack_ctx);
 
@@ -1765,10 +2552,18 @@ void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index)
         cnx->callback_ctx, path_x->app_path_ctx) != 0) {
         picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0, "Path deleted callback failed.");
     }
-    /* Remove old path data from retransmitted queue */
+    /* Remove old path data from the pending and retransmitted queues */
     /* TODO: what if using multiple number spaces? */
     for (picoquic_packet_context_enum pc = 0; pc < picoquic_nb_packet_context; pc++)
     {
+        p = cnx->pkt_ctx[pc].pending_first;
+        while (p != NULL) {
+            if (p->send_path == path_x) {
+                DBG_PRINTF("Erase path for pending packet pc: %d, seq:%" PRIu64 "\n", pc, p->sequence_number);
+                p->send_path = NULL;
+            }
+            p = p->packet_next;
+        }
         p = cnx->pkt_ctx[pc].retransmitted_newest;
         while (p != NULL) {
             if (p->send_path == path_x) {
@@ -1778,6 +2573,8 @@ void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index)
             p = p->packet_next;
         }
     }
+    /* The pending packets without a path are lost, do not wait for the deadline */
+    picoquic_reset_loss_check(cnx);
 
     if (cnx->is_multipath_enabled) {
         /* delete the local CID context used by the path */
@@ -1788,11 +2585,13 @@ void picoquic_delete_path(picoquic_cnx_t* cnx, int path_index)
     }
 
     /* Free the data and free the path context. */
+    picoquic_unindex_path(cnx, path_x);
     picoquic_clear_path_data(cnx, path_x);
 
     /* Compact the path table  */
     for (int i = path_index + 1; i < cnx->nb_paths; i++) {
         cnx->path[i-1] = cnx->path[i];
+        cnx->path[i-1]->cnx_path_index = i - 1;
     }
 
     cnx->nb_paths--;
@@ -1842,9 +2641,7 @@ void picoquic_delete_abandoned_paths(picoquic_cnx_t* cnx, uint64_t current_time,
             /* Then pack the list of paths */
             if (path_index_current > path_index_good) {
                 /* swap the path indexed good with current */
-                picoquic_path_t * path_x = cnx->path[path_index_current];
-                cnx->path[path_index_current] = cnx->path[path_index_good];
-                cnx->path[path_index_good] = path_x;
+                picoquic_swap_paths(cnx, path_index_current, path_index_good);
             }
             /* increment both indices */
             path_index_current++;
@@ -1904,6 +2701,7 @@ void picoquic_demote_path(picoquic_cnx_t* cnx, int path_index, uint64_t current_
         cnx->path[path_index]->path_is_demoted = 1;
         cnx->path[path_index]->demotion_time = current_time + 3* demote_timer;
         cnx->path_demotion_needed = 1;
+        picoquic_reset_loss_check(cnx);
 
         /* TODO: add suspended callback */
         if (cnx->is_multipath_enabled) {
@@ -1919,9 +2717,7 @@ void picoquic_demote_path(picoquic_cnx_t* cnx, int path_index, uint64_t current_
                     }
                 }
                 if (alt_path0 != 0) {
-                    picoquic_path_t* path_x = cnx->path[0];
-                    cnx->path[0] = cnx->path[alt_path0];
-                    cnx->path[alt_path0] = path_x;
+                    picoquic_swap_paths(cnx, 0, alt_path0);
                     path_index = alt_path0;
                 }
             }
@@ -1957,17 +2753,17 @@ void picoquic_demote_path(picoquic_cnx_t* cnx, int path_index, uint64_t current_
 
 
 /* set the challenge used for a tuple */
-void picoquic_set_tuple_challenge(picoquic_tuple_t * tuple, uint64_t current_time, int use_constant_challenges)
+void picoquic_set_tuple_challenge(picoquic_quic_t* quic, picoquic_tuple_t * tuple, uint64_t current_time)
 {
 
     /* Reset the tuple challenge */
     tuple->challenge_time_first = current_time;
     for (int ichal = 0; ichal < PICOQUIC_CHALLENGE_REPEAT_MAX; ichal++) {
-        if (use_constant_challenges) {
+        if (quic->use_constant_challenges) {
             tuple->challenge[ichal] = current_time * (0xdeadbeefull + ichal);
         }
         else {
-            tuple->challenge[ichal] = picoquic_public_random_64();
+            tuple->challenge[ichal] = picoquic_buffered_random_64(quic);
         }
     }
     tuple->challenge_time = current_time;
@@ -1980,7 +2776,7 @@ void picoquic_set_path_challenge(picoquic_cnx_t* cnx, int path_id, uint64_t curr
     if (!cnx->path[path_id]->first_tuple->challenge_required || cnx->path[path_id]->first_tuple->challenge_verified) {
         /* Reset the path challenge */
         cnx->path[path_id]->first_tuple->challenge_required = 1;
-        picoquic_set_tuple_challenge(cnx->path[path_id]->first_tuple, current_time, cnx->quic->use_constant_challenges);
+        picoquic_set_tuple_challenge(cnx->quic, cnx->path[path_id]->first_tuple, current_time);
         if (cnx->path[path_id]->first_tuple->challenge_verified && cnx->are_path_callbacks_enabled && cnx->callback_fn != NULL) {
             if (cnx->callback_fn(cnx, cnx->path[path_id]->unique_path_id, NULL, 0, picoquic_callback_path_suspended,
                 cnx->callback_ctx, cnx->path[path_id]->app_path_ctx) != 0) {
@@ -2044,11 +2840,19 @@ int picoquic_find_path_by_address(picoquic_cnx_t* cnx, const struct sockaddr* ad
 int picoquic_find_path_by_unique_id(picoquic_cnx_t* cnx, uint64_t unique_path_id)
 {
     int path_index = -1;
-    
-    for (int i = 0; i < cnx->nb_paths; i++) {
-        if (cnx->path[i]->unique_path_id == unique_path_id) {
-            path_index = i;
-            break;
+
+    if (cnx->path_index.nb_items > 0) {
+        picoquic_path_t* path_x = (picoquic_path_t*)picoradix_get(&cnx->path_index, unique_path_id);
+        if (path_x != NULL) {
+            path_index = path_x->cnx_path_index;
+        }
+    }
+    else {
+        for (int i = 0; i < cnx->nb_paths; i++) {
+            if (cnx->path[i]->unique_path_id == unique_path_id) {
+                path_index = i;
+                break;
+            }
         }
     }
 
@@ -2151,7 +2955,7 @@ int picoquic_check_new_path_allowed(picoquic_cnx_t* cnx, int to_preferred_addres
     else if (cnx->cnx_state < picoquic_state_client_almost_ready) {
         ret = PICOQUIC_ERROR_PATH_NOT_READY;
     }
-    else if (cnx->nb_paths >= PICOQUIC_NB_PATH_TARGET) {
+    else if (cnx->nb_paths >= picoquic_get_max_simultaneous_paths(cnx->quic)) {
         /* Too many paths created already */
         ret = PICOQUIC_ERROR_PATH_LIMIT_EXCEEDED;
     }
@@ -2288,7 +3092,7 @@ int picoquic_probe_new_tuple(picoquic_cnx_t* cnx, picoquic_path_t* path_x, struc
             ret = picoquic_assign_peer_cnxid_to_tuple(cnx, path_x, tuple);
             if (ret == 0) {
                 /* There was no NAT ongoing NAT rebinding, we created one, we need to initiate path challenges. */
-                picoquic_set_tuple_challenge(tuple, current_time, cnx->quic->use_constant_challenges);
+                picoquic_set_tuple_challenge(cnx->quic, tuple, current_time);
                 tuple->challenge_required = 1;
                 tuple->to_preferred_address = to_preferred_address;
             }
@@ -2354,16 +3158,7 @@ void picoquic_enable_path_callbacks_default(picoquic_quic_t* quic, int are_enabl
 
 int picoquic_get_path_id_from_unique(picoquic_cnx_t* cnx, uint64_t unique_path_id)
 {
-    int ret = -1;
-
-    for (int i = 0; i < cnx->nb_paths; i++) {
-        if (cnx->path[i]->unique_path_id == unique_path_id) {
-            ret = i;
-            break;
-        }
-    }
-
-    return ret;
+    return picoquic_find_path_by_unique_id(cnx, unique_path_id);
 }
 
 int picoquic_set_app_path_ctx(picoquic_cnx_t* cnx, uint64_t unique_path_id, void* app_path_ctx)
@@ -2503,9 +3298,9 @@ int picoquic_issue_path_quality_update(picoquic_cnx_t* cnx, picoquic_path_t* pat
     return ret;
 }
 
-static void picoquic_get_path_quality_from_context(picoquic_path_t* path_x, picoquic_path_quality_t* quality)
+/* Copy the path quality without resetting the thresholds of the quality update callback */
+void picoquic_copy_path_quality(picoquic_path_t* path_x, picoquic_path_quality_t* quality)
 {
-    picoquic_refresh_path_quality_thresholds(path_x);
     quality->cwin = path_x->cwin;
     quality->rtt = path_x->smoothed_rtt;
     quality->rtt_sample = path_x->rtt_sample;
@@ -2524,6 +3319,12 @@ static void picoquic_get_path_quality_from_context(picoquic_path_t* path_x, pico
     quality->bytes_in_transit = path_x->bytes_in_transit;
 }
 
+static void picoquic_get_path_quality_from_context(picoquic_path_t* path_x, picoquic_path_quality_t* quality)
+{
+    picoquic_refresh_path_quality_thresholds(path_x);
+    picoquic_copy_path_quality(path_x, quality);
+}
+
 int picoquic_get_path_quality(picoquic_cnx_t* cnx, uint64_t unique_path_id, picoquic_path_quality_t* quality)
 {
     int ret = -1;
@@ -2677,6 +3478,7 @@ void picoquic_reset_path_mtu(picoquic_path_t* path_x)
         PICOQUIC_INITIAL_MTU_IPV4 : PICOQUIC_INITIAL_MTU_IPV6;
     /* Reset the MTU discovery context */
     path_x->send_mtu_max_tried = 0;
+    path_x->send_mtu_cached = 0;
     path_x->mtu_probe_sent = 0;
 }
 
@@ -2697,7 +3499,7 @@ void picoquic_init_packet_ctx(picoquic_cnx_t* cnx, picoquic_packet_context_t* pk
 {
     if (cnx->quic->random_initial && 
         (pc == picoquic_packet_context_initial || cnx->quic->random_initial > 1)){
-        pkt_ctx->send_sequence = picoquic_crypto_uniform_random(cnx->quic, PICOQUIC_PN_RANDOM_RANGE) +
+        pkt_ctx->send_sequence = picoquic_buffered_uniform_random(cnx->quic, PICOQUIC_PN_RANDOM_RANGE) +
             PICOQUIC_PN_RANDOM_MIN;
     }
     else {
@@ -2705,6 +3507,13 @@ void picoquic_init_packet_ctx(picoquic_cnx_t* cnx, picoquic_packet_context_t* pk
     }
     pkt_ctx->pending_last = NULL;
     pkt_ctx->pending_first = NULL;
+    /* The queues and their index may have been handed to another context */
+    pkt_ctx->retransmitted_newest = NULL;
+    pkt_ctx->retransmitted_oldest = NULL;
+    pkt_ctx->retransmitted_queue_size = 0;
+    memset(&pkt_ctx->pending_index, 0, sizeof(picoquic_packet_index_t));
+    memset(&pkt_ctx->retransmitted_index, 0, sizeof(picoquic_packet_index_t));
+    pkt_ctx->loss_check_time = 0;
     pkt_ctx->highest_acknowledged = pkt_ctx->send_sequence - 1;
     pkt_ctx->latest_time_acknowledged = cnx->start_time;
     pkt_ctx->highest_acknowledged_time = cnx->start_time;
@@ -2735,6 +3544,78 @@ picoquic_remote_cnxid_stash_t* picoquic_find_or_create_remote_cnxid_stash(picoqu
     return remote_cnxid_stash;
 }
 
+#define PICOQUIC_REMOTE_CNXID_RING_MAX 1024
+
+/* Size the sequence ring for the number of CIDs that the peer may send,
+ * see picoquic_add_remote_cnxid_to_stash, and index the stashed CIDs.
+ * If the ring cannot be allocated, the CIDs remain found by scanning. */
+static void picoquic_remote_cnxid_ring_index(picoquic_remote_cnxid_stash_t* stash, picoquic_remote_cnxid_t* stashed)
+{
+    picoquic_remote_cnxid_t** slot = (stash->cnxid_ring == NULL) ? NULL :
+        &stash->cnxid_ring[stashed->sequence & (stash->cnxid_ring_size - 1)];
+
+    if (slot != NULL && *slot == NULL) {
+        *slot = stashed;
+        stashed->is_indexed = 1;
+    }
+    else {
+        stashed->is_indexed = 0;
+        stash->nb_cnxid_not_indexed++;
+    }
+}
+
+static void picoquic_remote_cnxid_ring_check(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* stash)
+{
+    size_t ring_size = 4;
+
+    while (ring_size < 2 * cnx->local_parameters.active_connection_id_limit + 1 && ring_size < PICOQUIC_REMOTE_CNXID_RING_MAX) {
+        ring_size *= 2;
+    }
+    if (ring_size > stash->cnxid_ring_size) {
+        picoquic_remote_cnxid_t** ring = (picoquic_remote_cnxid_t**)malloc(ring_size * sizeof(picoquic_remote_cnxid_t*));
+
+        if (ring != NULL) {
+            picoquic_remote_cnxid_t* stashed = stash->cnxid_stash_first;
+
+            memset(ring, 0, ring_size * sizeof(picoquic_remote_cnxid_t*));
+            if (stash->cnxid_ring != NULL) {
+                free(stash->cnxid_ring);
+            }
+            stash->cnxid_ring = ring;
+            stash->cnxid_ring_size = ring_size;
+            stash->nb_cnxid_not_indexed = 0;
+            while (stashed != NULL) {
+                picoquic_remote_cnxid_ring_index(stash, stashed);
+                stashed = stashed->next;
+            }
+        }
+    }
+}
+
+/* Find the CID of a given sequence number, e.g., when a RETIRE_CONNECTION_ID
+ * frame is acked. */
+picoquic_remote_cnxid_t* picoquic_find_cnxid_in_stash(picoquic_remote_cnxid_stash_t* stash, uint64_t sequence)
+{
+    picoquic_remote_cnxid_t* stashed = NULL;
+
+    if (stash != NULL) {
+        if (stash->cnxid_ring != NULL) {
+            stashed = stash->cnxid_ring[sequence & (stash->cnxid_ring_size - 1)];
+            if (stashed != NULL && stashed->sequence != sequence) {
+                stashed = NULL;
+            }
+        }
+        if (stashed == NULL && stash->nb_cnxid_not_indexed > 0) {
+            stashed = stash->cnxid_stash_first;
+            while (stashed != NULL && (stashed->is_indexed || stashed->sequence != sequence)) {
+                stashed = stashed->next;
+            }
+        }
+    }
+
+    return stashed;
+}
+
 int picoquic_init_cnxid_stash(picoquic_cnx_t* cnx)
 {
     int ret = 0;
@@ -2743,25 +3624,59 @@ int picoquic_init_cnxid_stash(picoquic_cnx_t* cnx)
         ret = PICOQUIC_TRANSPORT_INTERNAL_ERROR;
     }
     else {
-        remote_cnxid_stash->cnxid_stash_first = (picoquic_remote_cnxid_t*)malloc(sizeof(picoquic_remote_cnxid_t));
+        picoquic_remote_cnxid_ring_check(cnx, remote_cnxid_stash);
+        remote_cnxid_stash->cnxid_stash_first = (picoquic_remote_cnxid_t*)picoquic_object_alloc(cnx->quic, picoquic_object_remote_cnxid);
         cnx->path[0]->first_tuple->p_remote_cnxid = remote_cnxid_stash->cnxid_stash_first;
         if (remote_cnxid_stash->cnxid_stash_first == NULL) {
             ret = PICOQUIC_TRANSPORT_INTERNAL_ERROR;
         }
         else {
-            memset(remote_cnxid_stash->cnxid_stash_first, 0, sizeof(picoquic_remote_cnxid_t));
+            remote_cnxid_stash->cnxid_stash_last = remote_cnxid_stash->cnxid_stash_first;
+            picoquic_remote_cnxid_ring_index(remote_cnxid_stash, remote_cnxid_stash->cnxid_stash_first);
             remote_cnxid_stash->cnxid_stash_first->nb_path_references++;
 
             /* Initialize the reset secret to a random value. This
             * will prevent spurious matches to an all zero value, for example.
             * The real value will be set when receiving the transport parameters.
             */
-            picoquic_public_random(remote_cnxid_stash->cnxid_stash_first->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
+            picoquic_buffered_random(cnx->quic, remote_cnxid_stash->cnxid_stash_first->reset_secret, PICOQUIC_RESET_SECRET_SIZE);
         }
     }
     return ret;
 }
 
+/* Append a CID at the end of the stash, without any verification. This is
+ * used after the checks of picoquic_add_remote_cnxid_to_stash, and when
+ * importing a connection whose CIDs were checked by the exporting server.
+ */
+picoquic_remote_cnxid_t* picoquic_append_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* remote_cnxid_stash,
+    uint64_t sequence, const picoquic_connection_id_t* cnx_id, const uint8_t* secret_bytes)
+{
+    picoquic_remote_cnxid_t* stashed;
+
+    picoquic_remote_cnxid_ring_check(cnx, remote_cnxid_stash);
+    stashed = (picoquic_remote_cnxid_t*)picoquic_object_alloc(cnx->quic, picoquic_object_remote_cnxid);
+
+    if (stashed != NULL) {
+        stashed->cnx_id = *cnx_id;
+        stashed->sequence = sequence;
+        memcpy(stashed->reset_secret, secret_bytes, PICOQUIC_RESET_SECRET_SIZE);
+        stashed->next = NULL;
+        stashed->previous = remote_cnxid_stash->cnxid_stash_last;
+
+        if (remote_cnxid_stash->cnxid_stash_last == NULL) {
+            remote_cnxid_stash->cnxid_stash_first = stashed;
+        }
+        else {
+            remote_cnxid_stash->cnxid_stash_last->next = stashed;
+        }
+        remote_cnxid_stash->cnxid_stash_last = stashed;
+        picoquic_remote_cnxid_ring_index(remote_cnxid_stash, stashed);
+    }
+
+    return stashed;
+}
+
 uint64_t picoquic_add_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* remote_cnxid_stash, uint64_t retire_before,
     const uint64_t sequence, const uint8_t cid_length, const uint8_t* cnxid_bytes,
     const uint8_t* secret_bytes, picoquic_remote_cnxid_t** pstashed)
@@ -2771,7 +3686,6 @@ uint64_t picoquic_add_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote
     size_t nb_cid_received = 0;
     picoquic_connection_id_t cnx_id;
     picoquic_remote_cnxid_t* next_stash = remote_cnxid_stash->cnxid_stash_first;
-    picoquic_remote_cnxid_t* last_stash = NULL;
     picoquic_remote_cnxid_t* stashed = NULL;
     int nb_cid_retired_before = 0;
 
@@ -2815,7 +3729,6 @@ uint64_t picoquic_add_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote
             }
             nb_cid_received++;
         }
-        last_stash = next_stash;
         next_stash = next_stash->next;
     }
 
@@ -2825,25 +3738,11 @@ uint64_t picoquic_add_remote_cnxid_to_stash(picoquic_cnx_t* cnx, picoquic_remote
             ret = PICOQUIC_TRANSPORT_CONNECTION_ID_LIMIT_ERROR;
         }
         else {
-            stashed = (picoquic_remote_cnxid_t*)malloc(sizeof(picoquic_remote_cnxid_t));
+            stashed = picoquic_append_remote_cnxid_to_stash(cnx, remote_cnxid_stash, sequence, &cnx_id, secret_bytes);
 
             if (stashed == NULL) {
                 ret = PICOQUIC_TRANSPORT_INTERNAL_ERROR;
             }
-            else {
-                memset(stashed, 0, sizeof(picoquic_remote_cnxid_t));
-                (void)picoquic_parse_connection_id(cnxid_bytes, cid_length, &stashed->cnx_id);
-                stashed->sequence = sequence;
-                memcpy(stashed->reset_secret, secret_bytes, PICOQUIC_RESET_SECRET_SIZE);
-                stashed->next = NULL;
-
-                if (last_stash == NULL) {
-                    remote_cnxid_stash->cnxid_stash_first = stashed;
-                }
-                else {
-                    last_stash->next = stashed;
-                }
-            }
         }
     }
 
@@ -2873,40 +3772,39 @@ uint64_t picoquic_stash_remote_cnxid(picoquic_cnx_t* cnx, uint64_t retire_before
     return transport_error;
 }
 
+/* Remove a CID from the stash, and return the next one in the list. The
+ * previous argument is not needed anymore, but kept for the callers. */
 picoquic_remote_cnxid_t* picoquic_remove_cnxid_from_stash(picoquic_cnx_t* cnx, picoquic_remote_cnxid_stash_t* remote_cnxid_stash,
     picoquic_remote_cnxid_t* removed, picoquic_remote_cnxid_t* previous)
 {
     picoquic_remote_cnxid_t* stashed = NULL;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(previous);
+#endif
 
-    if (cnx != NULL && remote_cnxid_stash != NULL && remote_cnxid_stash->cnxid_stash_first != NULL && removed != NULL) {
-        stashed = remote_cnxid_stash->cnxid_stash_first;
-        /* Verify the value of the previous pointer */
-        if (previous != NULL) {
-            if (previous->next == removed) {
-                stashed = removed;
-            }
-            else {
-                previous = NULL;
-            }
+    /* Verify that the element is part of this stash */
+    if (cnx != NULL && remote_cnxid_stash != NULL && removed != NULL &&
+        ((removed->previous == NULL) ? remote_cnxid_stash->cnxid_stash_first == removed : removed->previous->next == removed)) {
+        stashed = removed->next;
+        if (removed->previous == NULL) {
+            remote_cnxid_stash->cnxid_stash_first = stashed;
         }
-        /* If the previous pointer was NULL or invalid, reset it */
-        if (previous == NULL) {
-            while (stashed != NULL && removed != stashed) {
-                previous = stashed;
-                stashed = stashed->next;
-            }
+        else {
+            removed->previous->next = stashed;
         }
-        /* Actually remove the element from the stash */
-        if (stashed != NULL) {
-            stashed = stashed->next;
-            if (previous == NULL) {
-                remote_cnxid_stash->cnxid_stash_first = stashed;
-            }
-            else {
-                previous->next = stashed;
-            }
-            free(removed);
+        if (stashed == NULL) {
+            remote_cnxid_stash->cnxid_stash_last = removed->previous;
+        }
+        else {
+            stashed->previous = removed->previous;
+        }
+        if (removed->is_indexed) {
+            remote_cnxid_stash->cnxid_ring[removed->sequence & (remote_cnxid_stash->cnxid_ring_size - 1)] = NULL;
+        }
+        else {
+            remote_cnxid_stash->nb_cnxid_not_indexed--;
         }
+        picoquic_object_free(cnx->quic, picoquic_object_remote_cnxid, removed);
     }
     return stashed;
 }
@@ -3068,6 +3966,9 @@ void picoquic_delete_remote_cnxid_stash(picoquic_cnx_t* cnx, picoquic_remote_cnx
     while (cnxid_stash->cnxid_stash_first != NULL) {
         picoquic_remove_cnxid_from_stash(cnx, cnxid_stash, cnxid_stash->cnxid_stash_first, NULL);
     }
+    if (cnxid_stash->cnxid_ring != NULL) {
+        free(cnxid_stash->cnxid_ring);
+    }
 
     if (previous == cnxid_stash) {
         cnx->first_remote_cnxid_stash = cnxid_stash->next_stash;
@@ -3165,16 +4066,222 @@ picosplay_node_t* picoquic_stream_data_node_create(void* value)
 }
 
 
+/* Memory accounting.
+ * Buffers whose number depends on the peer or the application are charged
+ * to the connection when queued, and discharged when released.
+ */
+void picoquic_memory_charge(picoquic_cnx_t* cnx, picoquic_memory_category_enum category, size_t size)
+{
+    cnx->memory_used[category] += size;
+    cnx->memory_used_total += size;
+    if (cnx->memory_used_total > cnx->memory_used_max) {
+        cnx->memory_used_max = cnx->memory_used_total;
+    }
+    cnx->quic->memory_used_total += size;
+}
+
+void picoquic_memory_discharge(picoquic_cnx_t* cnx, picoquic_memory_category_enum category, size_t size)
+{
+    if (cnx->memory_used[category] >= size) {
+        cnx->memory_used[category] -= size;
+        cnx->memory_used_total -= size;
+        cnx->quic->memory_used_total -= size;
+    }
+    else {
+        DBG_PRINTF("Memory discharge %" PRIst " above charge %" PRIst ", category %d", size, cnx->memory_used[category], (int)category);
+        cnx->memory_used_total -= cnx->memory_used[category];
+        cnx->quic->memory_used_total -= cnx->memory_used[category];
+        cnx->memory_used[category] = 0;
+    }
+}
+
+/* Return the part of a flow control credit increase that fits in the
+ * memory budget of the connection. */
+uint64_t picoquic_memory_budget_credit(picoquic_cnx_t* cnx, uint64_t credit_increase)
+{
+    if (cnx->memory_budget != 0) {
+        uint64_t available = (cnx->memory_used_total < cnx->memory_budget) ?
+            (uint64_t)(cnx->memory_budget - cnx->memory_used_total) : 0;
+        if (credit_increase > available) {
+            credit_increase = available;
+        }
+    }
+    return credit_increase;
+}
+
+int picoquic_memory_budget_exceeded(picoquic_cnx_t* cnx)
+{
+    return (cnx->memory_budget != 0 && cnx->memory_used_total >= cnx->memory_budget);
+}
+
+size_t picoquic_get_cnx_memory_usage(picoquic_cnx_t* cnx, picoquic_memory_category_enum category)
+{
+    return (category < picoquic_memory_category_max) ? cnx->memory_used[category] : 0;
+}
+
+size_t picoquic_get_cnx_memory_total(picoquic_cnx_t* cnx)
+{
+    return cnx->memory_used_total;
+}
+
+size_t picoquic_get_cnx_memory_max(picoquic_cnx_t* cnx)
+{
+    return cnx->memory_used_max;
+}
+
+size_t picoquic_get_quic_memory_total(picoquic_quic_t* quic)
+{
+    return quic->memory_used_total;
+}
+
+void picoquic_set_default_cnx_memory_budget(picoquic_quic_t* quic, size_t memory_budget)
+{
+    quic->default_cnx_memory_budget = memory_budget;
+}
+
+void picoquic_set_cnx_memory_budget(picoquic_cnx_t* cnx, size_t memory_budget)
+{
+    cnx->memory_budget = memory_budget;
+}
+
+size_t picoquic_get_cnx_memory_budget(picoquic_cnx_t* cnx)
+{
+    return cnx->memory_budget;
+}
+
+/* Hibernation of idle connections.
+ * A connection is quiet if it is ready, has nothing in flight and
+ * nothing queued for sending.
+ */
+int picoquic_is_cnx_quiet(picoquic_cnx_t* cnx)
+{
+    int is_quiet = (cnx->cnx_state == picoquic_state_ready &&
+        cnx->first_misc_frame == NULL && cnx->first_datagram == NULL &&
+        (cnx->datagram_ring == NULL || cnx->datagram_ring->nb_queued == 0) &&
+        cnx->first_output_stream == NULL && cnx->first_sooner == NULL &&
+        cnx->data_repeat_first == NULL && cnx->first_repeat_stream == NULL &&
+        !cnx->is_datagram_ready);
+
+    for (picoquic_packet_context_enum pc = 0; is_quiet && pc < picoquic_nb_packet_context; pc++) {
+        is_quiet = (cnx->pkt_ctx[pc].pending_first == NULL);
+    }
+
+    for (int i = 0; is_quiet && i < cnx->nb_paths; i++) {
+        is_quiet = (cnx->path[i]->bytes_in_transit == 0 && cnx->path[i]->pkt_ctx.pending_first == NULL);
+    }
+
+    return is_quiet;
+}
+
+/* Release the state that is only needed while the connection is active.
+ * Everything released here is recreated on demand, so waking up from
+ * hibernation only requires clearing the flag.
+ */
+void picoquic_hibernate_cnx(picoquic_cnx_t* cnx)
+{
+    /* Copies of packets kept after retransmission, only used to detect spurious repeats */
+    for (picoquic_packet_context_enum pc = 0; pc < picoquic_nb_packet_context; pc++) {
+        while (cnx->pkt_ctx[pc].retransmitted_newest != NULL) {
+            picoquic_dequeue_retransmitted_packet(cnx, &cnx->pkt_ctx[pc], cnx->pkt_ctx[pc].retransmitted_newest);
+        }
+        picoquic_packet_index_free(&cnx->pkt_ctx[pc].retransmitted_index);
+    }
+    for (int i = 0; i < cnx->nb_paths; i++) {
+        picoquic_packet_context_t* pkt_ctx = &cnx->path[i]->pkt_ctx;
+        while (pkt_ctx->retransmitted_newest != NULL) {
+            picoquic_dequeue_retransmitted_packet(cnx, pkt_ctx, pkt_ctx->retransmitted_newest);
+        }
+        picoquic_packet_index_free(&pkt_ctx->retransmitted_index);
+    }
+    /* Crypto streams of the epochs whose keys have been discarded */
+    for (int epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS - 1; epoch++) {
+        picoquic_crypto_context_t* ctx = &cnx->crypto_context[epoch];
+        if (ctx->aead_encrypt == NULL && ctx->aead_decrypt == NULL &&
+            ctx->pn_enc == NULL && ctx->pn_dec == NULL) {
+            picoquic_clear_stream(&cnx->tls_stream[epoch]);
+        }
+    }
+    /* Page tables of the empty stream indexes */
+    for (int k = 0; k < 4; k++) {
+        if (cnx->stream_index[k].nb_items == 0) {
+            picoradix_clear(&cnx->stream_index[k]);
+        }
+    }
+    /* There are no output streams in quiet connections */
+    picoquic_release_output_buckets(cnx);
+    /* The retry token is only used during the handshake */
+    if (cnx->retry_token != NULL) {
+        free(cnx->retry_token);
+        cnx->retry_token = NULL;
+        cnx->retry_token_length = 0;
+    }
+
+    cnx->is_hibernating = 1;
+    cnx->nb_hibernations++;
+}
+
+void picoquic_rehydrate_cnx(picoquic_cnx_t* cnx)
+{
+    cnx->is_hibernating = 0;
+}
+
+void picoquic_set_default_hibernation_delay(picoquic_quic_t* quic, uint64_t hibernation_delay)
+{
+    quic->default_hibernation_delay = hibernation_delay;
+}
+
+void picoquic_set_hibernation_delay(picoquic_cnx_t* cnx, uint64_t hibernation_delay)
+{
+    cnx->hibernation_delay = hibernation_delay;
+}
+
+int picoquic_is_cnx_hibernating(picoquic_cnx_t* cnx)
+{
+    return cnx->is_hibernating;
+}
+
+uint64_t picoquic_get_nb_hibernations(picoquic_cnx_t* cnx)
+{
+    return cnx->nb_hibernations;
+}
+
+void picoquic_stream_queue_node_free(picoquic_cnx_t* cnx, picoquic_stream_queue_node_t* stream_data)
+{
+    if (cnx != NULL) {
+        picoquic_memory_discharge(cnx, picoquic_memory_stream_send, PICOQUIC_STREAM_QUEUE_NODE_CHARGE(stream_data));
+    }
+    if (stream_data->release_fn != NULL) {
+        /* The application owns the bytes */
+        stream_data->release_fn(stream_data->release_ctx, stream_data->bytes, stream_data->length);
+    }
+    else if (stream_data->bytes != NULL && stream_data->bytes != PICOQUIC_STREAM_QUEUE_NODE_INLINE_BYTES(stream_data)) {
+        free(stream_data->bytes);
+    }
+    free(stream_data);
+}
+
 void* picoquic_stream_data_node_value(picosplay_node_t* node)
 {
     return (void*)((char*)node - offsetof(struct st_picoquic_stream_data_node_t, stream_data_node));
 }
 
-void picoquic_stream_data_node_recycle(picoquic_stream_data_node_t* stream_data)
+static picoquic_stream_data_node_t** picoquic_stream_data_node_pool_head(picoquic_quic_t* quic, size_t data_max)
+{
+    return (data_max == PICOQUIC_SMALL_PACKET_SIZE) ? &quic->p_first_small_data_node :
+        ((data_max == PICOQUIC_MAX_PACKET_SIZE) ? &quic->p_first_data_node : &quic->p_first_jumbo_data_node);
+}
+
+static void picoquic_stream_data_node_release(picoquic_stream_data_node_t* stream_data)
 {
-    if (stream_data->quic->nb_data_nodes_in_pool < PICOQUIC_MAX_PACKETS_IN_POOL) {
-        stream_data->next_stream_data = stream_data->quic->p_first_data_node;
-        stream_data->quic->p_first_data_node = stream_data;
+    if (stream_data->cnx != NULL) {
+        picoquic_memory_discharge(stream_data->cnx, picoquic_memory_stream_receive, PICOQUIC_DATA_NODE_ALLOC_SIZE(stream_data->data_max));
+        stream_data->cnx = NULL;
+    }
+    if ((size_t)stream_data->quic->nb_data_nodes_in_pool < stream_data->quic->tuning.max_data_nodes_in_pool ||
+        picoquic_is_prewarmed(stream_data->quic, stream_data)) {
+        picoquic_stream_data_node_t** p_first = picoquic_stream_data_node_pool_head(stream_data->quic, stream_data->data_max);
+        stream_data->next_stream_data = *p_first;
+        *p_first = stream_data;
         stream_data->quic->nb_data_nodes_in_pool++;
     }
     else {
@@ -3183,6 +4290,25 @@ void picoquic_stream_data_node_recycle(picoquic_stream_data_node_t* stream_data)
     }
 }
 
+/* Release one reference to a data node. The node only returns to the pool
+ * when the last reference is released. If the node was a view into the
+ * buffer of another node, the reference to that buffer is released too. */
+void picoquic_stream_data_node_recycle(picoquic_stream_data_node_t* stream_data)
+{
+    if (stream_data->nb_refs > 0) {
+        stream_data->nb_refs--;
+    }
+    else {
+        picoquic_stream_data_node_t* buffer_node = stream_data->buffer_node;
+
+        stream_data->buffer_node = NULL;
+        picoquic_stream_data_node_release(stream_data);
+        if (buffer_node != NULL) {
+            picoquic_stream_data_node_recycle(buffer_node);
+        }
+    }
+}
+
 void picoquic_stream_data_node_delete(void* tree, picosplay_node_t* node)
 {
     picoquic_stream_data_node_t* stream_data = (picoquic_stream_data_node_t*)picoquic_stream_data_node_value(node);
@@ -3190,20 +4316,51 @@ void picoquic_stream_data_node_delete(void* tree, picosplay_node_t* node)
     picoquic_stream_data_node_recycle(stream_data);
 }
 
-picoquic_stream_data_node_t* picoquic_stream_data_node_alloc(picoquic_quic_t* quic)
+/* Hold the buffer of the data passed to the current stream data callback.
+ * The buffer is no longer charged to the connection, since it may outlive it. */
+picoquic_stream_data_buffer_t* picoquic_hold_stream_data(picoquic_cnx_t* cnx)
 {
-    picoquic_stream_data_node_t* stream_data = quic->p_first_data_node;
+    picoquic_stream_data_node_t* buffer = cnx->delivered_data_node;
+
+    if (buffer != NULL) {
+        if (buffer->buffer_node != NULL) {
+            buffer = buffer->buffer_node;
+        }
+        if (buffer->cnx != NULL) {
+            picoquic_memory_discharge(buffer->cnx, picoquic_memory_stream_receive, PICOQUIC_DATA_NODE_ALLOC_SIZE(buffer->data_max));
+            buffer->cnx = NULL;
+        }
+        buffer->nb_refs++;
+    }
+
+    return buffer;
+}
+
+void picoquic_release_stream_data(picoquic_stream_data_buffer_t* buffer)
+{
+    if (buffer != NULL) {
+        picoquic_stream_data_node_recycle(buffer);
+    }
+}
+
+/* Allocate a node of the smallest size class that can hold "length" bytes */
+picoquic_stream_data_node_t* picoquic_stream_data_node_alloc_ex(picoquic_quic_t* quic, size_t length)
+{
+    size_t data_max = PICOQUIC_SIZE_CLASS(length);
+    picoquic_stream_data_node_t** p_first = picoquic_stream_data_node_pool_head(quic, data_max);
+    picoquic_stream_data_node_t* stream_data = *p_first;
     
     if (stream_data == NULL) {
         stream_data = (picoquic_stream_data_node_t*)
-            malloc(sizeof(picoquic_stream_data_node_t));
+            malloc(PICOQUIC_DATA_NODE_ALLOC_SIZE(data_max));
 
         if (stream_data != NULL) {
             /* It might be sufficient to zero the metadata, but zeroing everything
              * appears safer, and does not confuse checkers like valgrind.
              */
-            memset(stream_data, 0, sizeof(picoquic_stream_data_node_t));
+            memset(stream_data, 0, PICOQUIC_DATA_NODE_ALLOC_SIZE(data_max));
             stream_data->quic = quic;
+            stream_data->data_max = data_max;
             quic->nb_data_nodes_allocated++;
             if (quic->nb_data_nodes_allocated > quic->nb_data_nodes_allocated_max) {
                 quic->nb_data_nodes_allocated_max = quic->nb_data_nodes_allocated;
@@ -3211,15 +4368,22 @@ picoquic_stream_data_node_t* picoquic_stream_data_node_alloc(picoquic_quic_t* qu
         }
     }
     else {
-        quic->p_first_data_node = stream_data->next_stream_data;
+        *p_first = stream_data->next_stream_data;
         stream_data->next_stream_data = NULL;
         stream_data->bytes = NULL;
+        stream_data->buffer_node = NULL;
+        stream_data->nb_refs = 0;
         quic->nb_data_nodes_in_pool--;
     }
 
     return stream_data;
 }
 
+picoquic_stream_data_node_t* picoquic_stream_data_node_alloc(picoquic_quic_t* quic)
+{
+    return picoquic_stream_data_node_alloc_ex(quic, PICOQUIC_MAX_PACKET_SIZE);
+}
+
 
 /* Stream splay management */
 
@@ -3247,17 +4411,38 @@ void picoquic_clear_stream(picoquic_stream_head_t* stream)
 
     while ((next = ready) != NULL) {
         ready = next->next_stream_data;
-        if (next->bytes != NULL) {
-            free(next->bytes);
-        }
-        free(next);
+        picoquic_stream_queue_node_free(stream->cnx, next);
     }
     stream->send_queue = NULL;
+    if (stream->cork_node != NULL) {
+        /* Coalesced data is not charged until queued */
+        picoquic_stream_queue_node_free(NULL, stream->cork_node);
+        stream->cork_node = NULL;
+        stream->cork_capacity = 0;
+    }
     if (stream->is_output_stream) {
         picoquic_remove_output_stream(stream->cnx, stream);
     }
     picosplay_empty_tree(&stream->stream_data_tree);
+    picoquic_reassembly_ring_free(stream->cnx, stream);
     picoquic_sack_list_free(&stream->sack_list);
+    picoquic_stream_deadlines_free(stream);
+    picoquic_stream_retained_free(stream->cnx, stream);
+    picoquic_delivery_batch_forget_stream(stream->cnx, stream);
+    /* No event, the stream is being deleted */
+    stream->cnx->send_backlog -= stream->send_backlog;
+    stream->send_backlog = 0;
+}
+
+void picoquic_stream_deadlines_free(picoquic_stream_head_t* stream)
+{
+    picoquic_stream_deadline_t* next;
+
+    while ((next = stream->first_deadline) != NULL) {
+        stream->first_deadline = next->next_deadline;
+        free(next);
+    }
+    stream->last_deadline = NULL;
 }
 
 
@@ -3267,7 +4452,7 @@ static void picoquic_stream_node_delete(void * tree, picosplay_node_t * node)
 
     picoquic_clear_stream(stream);
 
-    free(stream);
+    picoquic_object_free(stream->cnx->quic, picoquic_object_stream, stream);
 }
 
 /* Management of streams */
@@ -3299,20 +4484,130 @@ picoquic_stream_head_t * picoquic_last_stream(picoquic_cnx_t* cnx)
 #endif
 }
 
-int picoquic_compare_stream_priority(picoquic_stream_head_t * stream, picoquic_stream_head_t * other) {
-    int ret = 1;
-    if (stream->stream_priority < other->stream_priority) {
-        ret = -1;
+/* Output scheduler.
+ * The output streams are kept in a single list, sorted by priority. The
+ * streams of each priority level form a contiguous "bucket" in that list.
+ * A bitmap marks the priority levels that have a bucket, and the buckets
+ * are stored in a dense array in priority order, so that the bucket of a
+ * level is found by counting the bits set below that level.
+ *
+ * Within a bucket, FIFO levels (odd priority) are sorted by stream ID.
+ * Round robin levels (even priority) are sorted by time of last service:
+ * streams that were never served come first, in stream ID order, and a
+ * stream that sends data moves to the end of its bucket. In both cases,
+ * the scheduler serves the first ready stream of the first bucket.
+ */
+static int picoquic_popcount64(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((x * 0x0101010101010101ull) >> 56);
+}
+
+static size_t picoquic_output_bucket_rank(picoquic_cnx_t* cnx, uint8_t priority)
+{
+    size_t rank = 0;
+    int word = priority / 64;
+
+    for (int i = 0; i < word; i++) {
+        rank += picoquic_popcount64(cnx->output_bucket_map[i]);
     }
-    else if (stream->stream_priority == other->stream_priority) {
-        if (stream->stream_id < other->stream_id) {
-            ret = -1;
-        }
-        else if (stream->stream_id == other->stream_id) {
-            ret = 0;
+    rank += picoquic_popcount64(cnx->output_bucket_map[word] & ((1ull << (priority % 64)) - 1));
+
+    return rank;
+}
+
+static picoquic_output_bucket_t* picoquic_find_output_bucket(picoquic_cnx_t* cnx, uint8_t priority)
+{
+    picoquic_output_bucket_t* bucket = NULL;
+
+    if ((cnx->output_bucket_map[priority / 64] & (1ull << (priority % 64))) != 0) {
+        bucket = &cnx->output_buckets[picoquic_output_bucket_rank(cnx, priority)];
+    }
+
+    return bucket;
+}
+
+static picoquic_output_bucket_t* picoquic_add_output_bucket(picoquic_cnx_t* cnx, uint8_t priority)
+{
+    picoquic_output_bucket_t* bucket = NULL;
+    size_t rank = picoquic_output_bucket_rank(cnx, priority);
+
+    if (cnx->nb_output_buckets >= cnx->output_buckets_allocated) {
+        size_t new_allocated = (cnx->output_buckets_allocated == 0) ? 4 : 2 * cnx->output_buckets_allocated;
+        picoquic_output_bucket_t* new_buckets = (picoquic_output_bucket_t*)realloc(cnx->output_buckets,
+            new_allocated * sizeof(picoquic_output_bucket_t));
+        if (new_buckets != NULL) {
+            cnx->output_buckets = new_buckets;
+            cnx->output_buckets_allocated = new_allocated;
         }
     }
-    return ret;
+
+    if (cnx->nb_output_buckets < cnx->output_buckets_allocated) {
+        bucket = &cnx->output_buckets[rank];
+        memmove(bucket + 1, bucket, (cnx->nb_output_buckets - rank) * sizeof(picoquic_output_bucket_t));
+        memset(bucket, 0, sizeof(picoquic_output_bucket_t));
+        bucket->priority = priority;
+        cnx->nb_output_buckets++;
+        cnx->output_bucket_map[priority / 64] |= (1ull << (priority % 64));
+    }
+
+    return bucket;
+}
+
+static void picoquic_delete_output_bucket(picoquic_cnx_t* cnx, picoquic_output_bucket_t* bucket)
+{
+    size_t rank = bucket - cnx->output_buckets;
+
+    cnx->output_bucket_map[bucket->priority / 64] &= ~(1ull << (bucket->priority % 64));
+    cnx->nb_output_buckets--;
+    memmove(bucket, bucket + 1, (cnx->nb_output_buckets - rank) * sizeof(picoquic_output_bucket_t));
+}
+
+void picoquic_release_output_buckets(picoquic_cnx_t* cnx)
+{
+    if (cnx->output_buckets != NULL) {
+        free(cnx->output_buckets);
+        cnx->output_buckets = NULL;
+    }
+    cnx->nb_output_buckets = 0;
+    cnx->output_buckets_allocated = 0;
+    memset(cnx->output_bucket_map, 0, sizeof(cnx->output_bucket_map));
+}
+
+/* Order of streams in a bucket, see the description of the output scheduler */
+static int picoquic_output_stream_is_before(picoquic_stream_head_t* stream, picoquic_stream_head_t* other)
+{
+    int is_before;
+
+    if ((stream->stream_priority & 1) == 0 && stream->last_time_data_sent != other->last_time_data_sent) {
+        is_before = stream->last_time_data_sent < other->last_time_data_sent;
+    }
+    else {
+        is_before = stream->stream_id < other->stream_id;
+    }
+
+    return is_before;
+}
+
+static void picoquic_link_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream,
+    picoquic_stream_head_t* previous, picoquic_stream_head_t* next)
+{
+    stream->previous_output_stream = previous;
+    stream->next_output_stream = next;
+    if (previous == NULL) {
+        cnx->first_output_stream = stream;
+    }
+    else {
+        previous->next_output_stream = stream;
+    }
+    if (next == NULL) {
+        cnx->last_output_stream = stream;
+    }
+    else {
+        next->previous_output_stream = stream;
+    }
 }
 
 /* This code assumes that the stream is not currently present in the output stream.
@@ -3321,58 +4616,58 @@ void picoquic_insert_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t*
 {
     if (stream->is_output_stream == 0)  
     {
+        picoquic_output_bucket_t* bucket;
+
         if (IS_CLIENT_STREAM_ID(stream->stream_id) == cnx->client_mode) {
             if (stream->stream_id > ((IS_BIDIR_STREAM_ID(stream->stream_id)) ? cnx->max_stream_id_bidir_remote : cnx->max_stream_id_unidir_remote)) {
                 return;
             }
         }
 
-        if (cnx->last_output_stream == NULL) {
-            /* insert first stream */
-            cnx->last_output_stream = stream;
-            cnx->first_output_stream = stream;
-        }
-        else if (picoquic_compare_stream_priority(stream, cnx->last_output_stream) >= 0) {
-            /* insert after last stream. Common case for most applications. */
-            stream->previous_output_stream = cnx->last_output_stream;
-            cnx->last_output_stream->next_output_stream = stream;
-            cnx->last_output_stream = stream;
+        if ((bucket = picoquic_find_output_bucket(cnx, stream->stream_priority)) == NULL) {
+            if ((bucket = picoquic_add_output_bucket(cnx, stream->stream_priority)) == NULL) {
+                (void)picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0, "Cannot allocate output bucket");
+                return;
+            }
+            else {
+                /* Insert before the first stream of the next priority level, if any */
+                size_t rank = bucket - cnx->output_buckets;
+                picoquic_stream_head_t* next = (rank + 1 < cnx->nb_output_buckets) ? cnx->output_buckets[rank + 1].first : NULL;
+
+                picoquic_link_output_stream(cnx, stream, (next == NULL) ? cnx->last_output_stream : next->previous_output_stream, next);
+                bucket->first = stream;
+                bucket->last = stream;
+            }
         }
         else {
-            picoquic_stream_head_t* current = cnx->first_output_stream;
-
-            while (current != NULL) {
-                int cmp = picoquic_compare_stream_priority(stream, current);
-
-                if (cmp < 0) {
-                    /* insert before the current stream, then break */
-                    stream->previous_output_stream = current->previous_output_stream;
-                    if (stream->previous_output_stream == NULL) {
-                        cnx->first_output_stream = stream;
-                    }
-                    else {
-                        stream->previous_output_stream->next_output_stream = stream;
-                    }
-                    current->previous_output_stream = stream;
-                    stream->next_output_stream = current;
-                    break;
-                }
-                else if (cmp == 0) {
-                    /* Stream is already there. This is unexpected */
-                    break;
-                }
-                else {
-                    current = current->next_output_stream;
+            /* Streams never served are looked up from the last of them, others from the end of the bucket.
+             * In the common cases, new streams have the highest ID and served streams the latest time,
+             * so the loop ends at once. */
+            int is_unserved = ((stream->stream_priority & 1) == 0 && stream->last_time_data_sent == 0);
+            picoquic_stream_head_t* previous = (is_unserved) ? bucket->last_unserved : bucket->last;
+
+            while (previous != NULL && picoquic_output_stream_is_before(stream, previous)) {
+                previous = (previous == bucket->first) ? NULL : previous->previous_output_stream;
+            }
+            if (previous == NULL) {
+                picoquic_link_output_stream(cnx, stream, bucket->first->previous_output_stream, bucket->first);
+                bucket->first = stream;
+            }
+            else {
+                picoquic_link_output_stream(cnx, stream, previous, previous->next_output_stream);
+                if (previous == bucket->last) {
+                    bucket->last = stream;
                 }
             }
-            if (current == NULL) {
-                /* insert after last stream */
-                stream->previous_output_stream = cnx->last_output_stream;
-                cnx->last_output_stream->next_output_stream = stream;
-                cnx->last_output_stream = stream;
+            if (is_unserved && previous == bucket->last_unserved) {
+                bucket->last_unserved = stream;
             }
         }
+        if ((stream->stream_priority & 1) == 0 && stream->last_time_data_sent == 0 && bucket->last_unserved == NULL) {
+            bucket->last_unserved = stream;
+        }
 
+        stream->output_priority = stream->stream_priority;
         stream->is_output_stream = 1;
     }
 }
@@ -3380,8 +4675,27 @@ void picoquic_insert_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t*
 void picoquic_remove_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t * stream)
 {
     if (stream->is_output_stream) {
+        picoquic_output_bucket_t* bucket = picoquic_find_output_bucket(cnx, stream->output_priority);
+
         stream->is_output_stream = 0;
 
+        if (bucket != NULL) {
+            if (bucket->first == stream && bucket->last == stream) {
+                picoquic_delete_output_bucket(cnx, bucket);
+            }
+            else {
+                if (bucket->last_unserved == stream) {
+                    bucket->last_unserved = (bucket->first == stream) ? NULL : stream->previous_output_stream;
+                }
+                if (bucket->first == stream) {
+                    bucket->first = stream->next_output_stream;
+                }
+                if (bucket->last == stream) {
+                    bucket->last = stream->previous_output_stream;
+                }
+            }
+        }
+
         if (stream->previous_output_stream == NULL) {
             cnx->first_output_stream = stream->next_output_stream;
         }
@@ -3400,25 +4714,61 @@ void picoquic_remove_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t *
     }
 }
 
-/* Reorder streams by priorities and rank.
- * A stream is deemed out of order if:
- * - the previous stream in the list has a higher priority, or
- * - the new stream has a lower priority.
+/* Move the stream to the bucket matching its current priority, if it was changed.
  */
 void picoquic_reorder_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
 {
-    if (stream->is_output_stream) {
-        if ((stream->previous_output_stream != NULL &&
-            picoquic_compare_stream_priority(stream, stream->previous_output_stream) < 0) ||
-            (stream->next_output_stream != NULL &&
-                picoquic_compare_stream_priority(stream, stream->next_output_stream) > 0)) {
+    if (stream->is_output_stream && stream->output_priority != stream->stream_priority) {
+        picoquic_remove_output_stream(cnx, stream);
+        picoquic_insert_output_stream(cnx, stream);
+    }
+}
+
+/* After a round robin stream was served, move it to the end of its bucket.
+ */
+void picoquic_requeue_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->is_output_stream && (stream->output_priority & 1) == 0) {
+        picoquic_output_bucket_t* bucket = picoquic_find_output_bucket(cnx, stream->output_priority);
+
+        if (bucket != NULL && bucket->last != stream) {
             picoquic_remove_output_stream(cnx, stream);
-            stream->is_output_stream = 0;
             picoquic_insert_output_stream(cnx, stream);
         }
     }
 }
 
+/* Move the stream to the front of its bucket, so that a pending reset or
+ * stop sending is processed before the data of other streams at the same level.
+ */
+void picoquic_promote_output_stream(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->is_output_stream) {
+        picoquic_output_bucket_t* bucket = picoquic_find_output_bucket(cnx, stream->output_priority);
+
+        if (bucket != NULL && bucket->first != stream) {
+            picoquic_stream_head_t* first = bucket->first;
+
+            if (bucket->last_unserved == stream) {
+                bucket->last_unserved = stream->previous_output_stream;
+            }
+            if (bucket->last == stream) {
+                bucket->last = stream->previous_output_stream;
+            }
+            /* Unlink, then insert before the first stream of the bucket */
+            stream->previous_output_stream->next_output_stream = stream->next_output_stream;
+            if (stream->next_output_stream == NULL) {
+                cnx->last_output_stream = stream->previous_output_stream;
+            }
+            else {
+                stream->next_output_stream->previous_output_stream = stream->previous_output_stream;
+            }
+            picoquic_link_output_stream(cnx, stream, first->previous_output_stream, first);
+            bucket->first = stream;
+        }
+    }
+}
+
 picoquic_stream_head_t * picoquic_next_stream(picoquic_stream_head_t * stream)
 {
     return (picoquic_stream_head_t *)picosplay_next((picosplay_node_t *)stream);
@@ -3426,10 +4776,17 @@ picoquic_stream_head_t * picoquic_next_stream(picoquic_stream_head_t * stream)
 
 picoquic_stream_head_t* picoquic_find_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
 {
-    picoquic_stream_head_t target;
-    target.stream_id = stream_id;
+    picoquic_stream_head_t* stream = (picoquic_stream_head_t*)picoradix_get(
+        &cnx->stream_index[STREAM_TYPE_FROM_ID(stream_id)], stream_id >> 2);
+
+    if (stream == NULL && cnx->nb_streams_not_indexed > 0) {
+        picoquic_stream_head_t target;
+        target.stream_id = stream_id;
+
+        stream = (picoquic_stream_head_t*)picosplay_find(&cnx->stream_tree, (void*)&target);
+    }
 
-    return (picoquic_stream_head_t *)picosplay_find(&cnx->stream_tree, (void*)&target);
+    return stream;
 }
 
 void picoquic_add_output_streams(picoquic_cnx_t* cnx, uint64_t old_limit, uint64_t new_limit, unsigned int is_bidir)
@@ -3453,9 +4810,8 @@ void picoquic_add_output_streams(picoquic_cnx_t* cnx, uint64_t old_limit, uint64
 
 picoquic_stream_head_t* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
 {
-    picoquic_stream_head_t* stream = (picoquic_stream_head_t*)malloc(sizeof(picoquic_stream_head_t));
+    picoquic_stream_head_t* stream = (picoquic_stream_head_t*)picoquic_object_alloc(cnx->quic, picoquic_object_stream);
     if (stream != NULL) {
-        memset(stream, 0, sizeof(picoquic_stream_head_t));
         picoquic_sack_list_init(&stream->sack_list);
     }
 
@@ -3495,6 +4851,9 @@ picoquic_stream_head_t* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t str
         picosplay_init_tree(&stream->stream_data_tree, picoquic_stream_data_node_compare, picoquic_stream_data_node_create, picoquic_stream_data_node_delete, picoquic_stream_data_node_value);
 
         picosplay_insert(&cnx->stream_tree, stream);
+        if (picoradix_set(&cnx->stream_index[STREAM_TYPE_FROM_ID(stream_id)], stream_id >> 2, stream) != 0) {
+            cnx->nb_streams_not_indexed++;
+        }
         if (is_output_stream) {
             picoquic_insert_output_stream(cnx, stream);
         }
@@ -3513,6 +4872,10 @@ picoquic_stream_head_t* picoquic_create_stream(picoquic_cnx_t* cnx, uint64_t str
 
 void picoquic_delete_stream(picoquic_cnx_t * cnx, picoquic_stream_head_t* stream)
 {
+    if (picoradix_remove(&cnx->stream_index[STREAM_TYPE_FROM_ID(stream->stream_id)], stream->stream_id >> 2) == NULL &&
+        cnx->nb_streams_not_indexed > 0) {
+        cnx->nb_streams_not_indexed--;
+    }
     picosplay_delete(&cnx->stream_tree, stream);
 }
 
@@ -3552,7 +4915,9 @@ int picoquic_mark_direct_receive_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
             }
 
             if (length > 0) {
+                cnx->delivered_data_node = data;
                 ret = direct_receive_fn(cnx, stream_id, 0, data->bytes, offset, length, direct_receive_ctx);
+                cnx->delivered_data_node = NULL;
             }
 
             if (ret == 0) {
@@ -3573,6 +4938,92 @@ int picoquic_mark_direct_receive_stream(picoquic_cnx_t* cnx, uint64_t stream_id,
     return ret;
 }
 
+#define PICOQUIC_REASSEMBLY_RING_ALLOC_SIZE(size) (sizeof(picoquic_reassembly_ring_t) + (size) + (size) / 8)
+
+void picoquic_reassembly_ring_free(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->reassembly_ring != NULL) {
+        picoquic_memory_discharge(cnx, picoquic_memory_stream_receive, PICOQUIC_REASSEMBLY_RING_ALLOC_SIZE(stream->reassembly_ring->size));
+        free(stream->reassembly_ring);
+        stream->reassembly_ring = NULL;
+    }
+}
+
+int picoquic_set_stream_reassembly_ring(picoquic_cnx_t* cnx, uint64_t stream_id, size_t ring_size)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+    if (stream == NULL) {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else if (!IS_BIDIR_STREAM_ID(stream_id) && IS_LOCAL_STREAM_ID(stream_id, cnx->client_mode)) {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else if (stream->reassembly_ring != NULL) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_STATE;
+    }
+    else {
+        /* The ring cannot be smaller than the window already granted to the peer */
+        uint64_t window = (stream->maxdata_local > stream->consumed_offset) ? stream->maxdata_local - stream->consumed_offset : 0;
+        picoquic_reassembly_ring_t* ring = NULL;
+
+        if (window > (uint64_t)ring_size) {
+            ring_size = (window > (uint64_t)(SIZE_MAX / 2)) ? 0 : (size_t)window;
+        }
+        ring_size = (ring_size + 63) & ~((size_t)63);
+        if (ring_size == 0 || ring_size > SIZE_MAX / 2 ||
+            (ring = (picoquic_reassembly_ring_t*)malloc(PICOQUIC_REASSEMBLY_RING_ALLOC_SIZE(ring_size))) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            picoquic_stream_data_node_t* data;
+
+            memset(ring, 0, sizeof(picoquic_reassembly_ring_t));
+            ring->received = (uint64_t*)(ring + 1);
+            ring->buffer = (uint8_t*)(ring->received + ring_size / 64);
+            memset(ring->received, 0, ring_size / 8);
+            ring->size = ring_size;
+            ring->base_offset = stream->consumed_offset;
+            stream->reassembly_ring = ring;
+            picoquic_memory_charge(cnx, picoquic_memory_stream_receive, PICOQUIC_REASSEMBLY_RING_ALLOC_SIZE(ring_size));
+            /* Move the data already queued to the ring, as long as it fits in the window */
+            while ((data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree)) != NULL &&
+                picoquic_reassembly_ring_input(stream, data->offset, data->bytes, data->length) == data->length) {
+                picosplay_delete_hint(&stream->stream_data_tree, &data->stream_data_node);
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_set_app_flow_control(picoquic_cnx_t* cnx, uint64_t stream_id, int enable)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+    if (stream == NULL) {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else if (!IS_BIDIR_STREAM_ID(stream_id) && IS_LOCAL_STREAM_ID(stream_id, cnx->client_mode)) {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else if (enable) {
+        if (!stream->is_app_flow_controlled) {
+            stream->is_app_flow_controlled = 1;
+            stream->app_consumed_offset = stream->consumed_offset;
+        }
+    }
+    else if (stream->is_app_flow_controlled) {
+        /* Release the credit that was withheld */
+        ret = picoquic_stream_data_consumed(cnx, stream_id, stream->consumed_offset);
+        stream->is_app_flow_controlled = 0;
+    }
+
+    return ret;
+}
+
 
 /* Management of local CID.
  * Local CID are created and registered on demand.
@@ -3617,10 +5068,9 @@ picoquic_local_cnxid_t* picoquic_create_local_cnxid(picoquic_cnx_t* cnx,
     int is_unique = 0;
 
     if (local_cnxid_list != NULL) {
-        l_cid = (picoquic_local_cnxid_t*)malloc(sizeof(picoquic_local_cnxid_t));
+        l_cid = (picoquic_local_cnxid_t*)picoquic_object_alloc(cnx->quic, picoquic_object_local_cnxid);
 
         if (l_cid != NULL) {
-            memset(l_cid, 0, sizeof(picoquic_local_cnxid_t));
             l_cid->create_time = current_time;
 
             if (cnx->quic->local_cnxid_length == 0) {
@@ -3670,7 +5120,7 @@ picoquic_local_cnxid_t* picoquic_create_local_cnxid(picoquic_cnx_t* cnx,
                 }
             }
             else {
-                free(l_cid);
+                picoquic_object_free(cnx->quic, picoquic_object_local_cnxid, l_cid);
                 l_cid = NULL;
             }
         }
@@ -3729,8 +5179,12 @@ void picoquic_delete_local_cnxid_listed(picoquic_cnx_t* cnx,
         }
     }
 
+    if (cnx->quic->last_incoming_l_cid == l_cid) {
+        cnx->quic->last_incoming_l_cid = NULL;
+    }
+
     /* Delete and done */
-    free(l_cid);
+    picoquic_object_free(cnx->quic, picoquic_object_local_cnxid, l_cid);
 }
 
 void picoquic_delete_local_cnxid(picoquic_cnx_t* cnx,  picoquic_local_cnxid_t* l_cid)
@@ -3850,13 +5304,12 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
     const struct sockaddr* addr_to, uint64_t start_time, uint32_t preferred_version,
     char const* sni, char const* alpn, char client_mode)
 {
-    picoquic_cnx_t* cnx = (picoquic_cnx_t*)malloc(sizeof(picoquic_cnx_t));
+    picoquic_cnx_t* cnx = (picoquic_cnx_t*)picoquic_object_alloc(quic, picoquic_object_cnx);
 
     if (cnx != NULL) {
         int ret;
         picoquic_local_cnxid_t* cnxid0;
 
-        memset(cnx, 0, sizeof(picoquic_cnx_t));
         cnx->start_time = start_time;
         cnx->phase_delay = INT64_MAX;
         cnx->client_mode = client_mode;
@@ -3876,9 +5329,6 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
         cnx->rtt_update_delta = quic->rtt_update_delta;
         cnx->pacing_rate_update_delta = quic->pacing_rate_update_delta;
 
-        /* Initialize the stream data repeat queue */
-        picoquic_queue_data_repeat_init(cnx);
-
         /* Initialize the connection ID stash */
         ret = picoquic_create_path(cnx, start_time, NULL, addr_to, 0, 0);
         if (ret == 0) {
@@ -3944,6 +5394,13 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
            /* Accept and send BDP extension frame */
             cnx->local_parameters.enable_bdp_frame = 1;
         }
+
+        /* Initialize the FEC transport parameter */
+        if (quic->default_fec_block_size > 0) {
+            cnx->local_parameters.enable_fec = 1;
+            cnx->fec_block_size = quic->default_fec_block_size;
+        }
+        PICOQUIC_LEAN_TRANSPORT_PARAMETERS(&cnx->local_parameters);
  
         /* Initialize local flow control variables to advertised values */
         cnx->maxdata_local = ((uint64_t)cnx->local_parameters.initial_max_data);
@@ -3982,13 +5439,21 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
         cnx->callback_fn = quic->default_callback_fn;
         cnx->callback_ctx = quic->default_callback_ctx;
         cnx->congestion_alg = quic->default_congestion_alg;
+        cnx->path_scheduler = quic->default_path_scheduler;
         cnx->is_preemptive_repeat_enabled = quic->is_preemptive_repeat_enabled;
+        cnx->is_stream_repeat_from_queue = quic->is_stream_repeat_from_queue;
+        cnx->is_fast_port_rebinding = quic->is_fast_port_rebinding;
 
         /* Initialize key rotation interval to default value */
         cnx->crypto_epoch_length_max = quic->crypto_epoch_length_max;
 
+        cnx->memory_budget = quic->default_cnx_memory_budget;
+        cnx->hibernation_delay = quic->default_hibernation_delay;
+        picoquic_cnx_stats_attach(cnx);
+
         for (int epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS; epoch++) {
             cnx->tls_stream[epoch].send_queue = NULL;
+            cnx->tls_stream[epoch].cnx = cnx;
         }
 
         /* Perform different initializations for clients and servers */
@@ -4089,6 +5554,10 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
 
 
         picosplay_init_tree(&cnx->stream_tree, picoquic_stream_node_compare, picoquic_stream_node_create, picoquic_stream_node_delete, picoquic_stream_node_value);
+        for (int i = 0; i < 4; i++) {
+            picoradix_init(&cnx->stream_index[i]);
+        }
+        picoradix_init(&cnx->path_index);
 
         cnx->congestion_alg = cnx->quic->default_congestion_alg;
         cnx->congestion_alg_option_string = cnx->quic->default_congestion_alg_option_string;
@@ -4121,13 +5590,18 @@ picoquic_cnx_t* picoquic_create_cnx(picoquic_quic_t* quic,
     }
 
     if (quic->use_unique_log_names) {
-        picoquic_crypto_random(quic, &cnx->log_unique, sizeof(cnx->log_unique));
+        picoquic_buffered_random(quic, &cnx->log_unique, sizeof(cnx->log_unique));
     }
 
     if (cnx != NULL && !cnx->client_mode) {
         picoquic_log_new_connection(cnx);
     }
 
+    if (cnx != NULL) {
+        picoquic_cc_manager_seed(cnx);
+        picoquic_careful_resume_seed(cnx, start_time);
+    }
+
     return cnx;
 }
 
@@ -4185,9 +5659,180 @@ int picoquic_start_client_cnx(picoquic_cnx_t * cnx)
     return ret;
 }
 
+/* Happy eyeballs connection racing.
+ * The application connection is started immediately. The secondary
+ * connection is created at the same time, but stays in the client init
+ * state until its start time, or until the first connection fails. The
+ * race is evaluated each time one of the connections prepares packets,
+ * and when the application asks for the winner. The loser is silenced
+ * by replacing its callback, and closed cleanly. A secondary connection
+ * that loses is deleted by the stack once disconnected; if the application
+ * connection loses, it is kept until the application deletes the winner.
+ */
+static int picoquic_race_loser_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* stream_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(fin_or_event);
+    UNREFERENCED_PARAMETER(callback_ctx);
+    UNREFERENCED_PARAMETER(stream_ctx);
+#endif
+    return 0;
+}
+
+static int picoquic_race_is_failed(picoquic_cnx_t* cnx)
+{
+    return (cnx->cnx_state == picoquic_state_handshake_failure ||
+        cnx->cnx_state == picoquic_state_handshake_failure_resend ||
+        cnx->cnx_state >= picoquic_state_disconnecting);
+}
+
+static int picoquic_race_is_established(picoquic_cnx_t* cnx)
+{
+    return (cnx->cnx_state >= picoquic_state_client_almost_ready &&
+        cnx->cnx_state <= picoquic_state_ready &&
+        cnx->cnx_state != picoquic_state_server_false_start &&
+        cnx->cnx_state != picoquic_state_server_almost_ready);
+}
+
+static int picoquic_race_start_secondary(picoquic_cnx_t* cnx, picoquic_cnx_t* peer)
+{
+    /* The application may have changed the callback after creating the race. */
+    cnx->race_start_time = 0;
+    cnx->callback_fn = peer->callback_fn;
+    cnx->callback_ctx = peer->callback_ctx;
+
+    return picoquic_start_client_cnx(cnx);
+}
+
+static void picoquic_race_set_loser(picoquic_cnx_t* loser, uint64_t current_time)
+{
+    loser->is_race_loser = 1;
+    loser->callback_fn = picoquic_race_loser_callback;
+    loser->callback_ctx = NULL;
+
+    if (loser->race_start_time != 0) {
+        /* Never started, there is nothing to tell the peer. */
+        loser->race_start_time = 0;
+        loser->cnx_state = picoquic_state_disconnected;
+        picoquic_reinsert_by_wake_time(loser->quic, loser, current_time);
+    }
+    else if (!picoquic_race_is_failed(loser)) {
+        (void)picoquic_close(loser, 0);
+    }
+}
+
+void picoquic_race_update(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_cnx_t* peer = cnx->race_peer;
+
+    if (peer == NULL || cnx->is_race_loser) {
+        /* Not racing, or already out of the race */
+    }
+    else if (cnx->race_start_time != 0) {
+        if (current_time >= cnx->race_start_time || peer->is_race_loser || picoquic_race_is_failed(peer)) {
+            if (picoquic_race_start_secondary(cnx, peer) != 0) {
+                picoquic_race_set_loser(cnx, current_time);
+            }
+        }
+    }
+    else if (peer->is_race_loser) {
+        /* The race is decided */
+    }
+    else if (picoquic_race_is_established(cnx)) {
+        picoquic_log_app_message(cnx, "Won the connection race, closing the %s connection",
+            (peer->race_start_time != 0) ? "unstarted" : "other");
+        picoquic_race_set_loser(peer, current_time);
+    }
+    else if (picoquic_race_is_failed(cnx)) {
+        /* Let the other connection continue alone, and start it now if it was waiting.
+         * If it cannot start, the failure is reported on this connection. */
+        if (peer->race_start_time == 0 || picoquic_race_start_secondary(peer, cnx) == 0) {
+            picoquic_race_set_loser(cnx, current_time);
+        }
+    }
+}
+
+picoquic_cnx_t* picoquic_create_racing_cnx(picoquic_quic_t* quic,
+    struct sockaddr* addr_first, struct sockaddr* addr_second, uint64_t start_time, uint32_t preferred_version,
+    char const* sni, char const* alpn, picoquic_stream_data_cb_fn callback_fn, void* callback_ctx,
+    uint64_t race_delay)
+{
+    picoquic_cnx_t* cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        addr_first, start_time, preferred_version, sni, alpn, 1);
+
+    if (cnx != NULL) {
+        if (callback_fn != NULL)
+            cnx->callback_fn = callback_fn;
+        if (callback_ctx != NULL)
+            cnx->callback_ctx = callback_ctx;
+
+        if (addr_second != NULL && addr_second->sa_family != 0) {
+            picoquic_cnx_t* secondary = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+                addr_second, start_time, preferred_version, sni, alpn, 1);
+
+            if (secondary == NULL) {
+                picoquic_delete_cnx(cnx);
+                cnx = NULL;
+            }
+            else {
+                secondary->is_race_secondary = 1;
+                secondary->race_start_time = start_time + race_delay;
+                if (secondary->race_start_time == 0) {
+                    secondary->race_start_time = 1;
+                }
+                secondary->callback_fn = cnx->callback_fn;
+                secondary->callback_ctx = cnx->callback_ctx;
+                secondary->race_peer = cnx;
+                cnx->race_peer = secondary;
+                picoquic_reinsert_by_wake_time(quic, secondary, secondary->race_start_time);
+            }
+        }
+    }
+
+    if (cnx != NULL && picoquic_start_client_cnx(cnx) != 0) {
+        /* Also deletes the secondary connection, if any */
+        picoquic_delete_cnx(cnx);
+        cnx = NULL;
+    }
+
+    return cnx;
+}
+
+picoquic_cnx_t* picoquic_get_race_winner(picoquic_cnx_t* cnx)
+{
+    picoquic_cnx_t* winner = NULL;
+
+    if (cnx->race_peer == NULL) {
+        winner = (cnx->is_race_loser) ? NULL : cnx;
+    }
+    else {
+        uint64_t current_time = picoquic_get_quic_time(cnx->quic);
+
+        /* The state may have changed since the last packet was prepared */
+        picoquic_race_update(cnx, current_time);
+        picoquic_race_update(cnx->race_peer, current_time);
+
+        if (cnx->is_race_loser) {
+            winner = (cnx->race_peer->is_race_loser) ? NULL : cnx->race_peer;
+        }
+        else if (cnx->race_peer->is_race_loser) {
+            winner = cnx;
+        }
+    }
+
+    return winner;
+}
+
 void picoquic_set_transport_parameters(picoquic_cnx_t * cnx, picoquic_tp_t const * tp)
 {
     cnx->local_parameters = *tp;
+    PICOQUIC_LEAN_TRANSPORT_PARAMETERS(&cnx->local_parameters);
 
     if (cnx->quic->mtu_max > 0 && cnx->local_parameters.max_packet_size == 0)
     {
@@ -4291,6 +5936,7 @@ void picoquic_seed_bandwidth(picoquic_cnx_t* cnx, uint64_t rtt_min, uint64_t cwi
 {
     cnx->seed_rtt_min = rtt_min;
     cnx->seed_cwin = cwin;
+    cnx->is_careful_resume_seeded = 0;
     if (ip_addr_length > PICOQUIC_STORED_IP_MAX) {
         ip_addr_length = PICOQUIC_STORED_IP_MAX;
     }
@@ -4358,6 +6004,114 @@ uint64_t picoquic_current_time()
     return now;
 }
 
+/*
+ * Read a cheap cycle counter, for CPU cost accounting. The unit depends on
+ * the platform: TSC cycles on x86, virtual counter ticks on ARM64, and
+ * wall time microseconds elsewhere.
+ */
+uint64_t picoquic_cpu_ticks()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return picoquic_current_time();
+#endif
+}
+
+/*
+ * CPU time used by the calling thread, in microseconds, or 0 if the
+ * platform does not provide it. Used to report the CPU utilisation
+ * of network threads.
+ */
+uint64_t picoquic_thread_cpu_time()
+{
+#ifdef _WINDOWS
+    FILETIME creation_time;
+    FILETIME exit_time;
+    FILETIME kernel_time;
+    FILETIME user_time;
+    uint64_t cpu_time = 0;
+
+    if (GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+        uint64_t k = ((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime;
+        uint64_t u = ((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime;
+        /* Convert units from 100ns to 1us */
+        cpu_time = (k + u) / 10;
+    }
+    return cpu_time;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec cpu_time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time) != 0) {
+        return 0;
+    }
+    return (cpu_time.tv_sec * 1000000ull) + cpu_time.tv_nsec / 1000ull;
+#else
+    return 0;
+#endif
+}
+
+void picoquic_set_cpu_accounting(picoquic_quic_t* quic, int enable)
+{
+    quic->is_cpu_accounting_enabled = (enable) ? 1 : 0;
+}
+
+void picoquic_set_adaptive_ack_frequency(picoquic_quic_t* quic, int enable)
+{
+    quic->is_adaptive_ack_frequency_enabled = (enable) ? 1 : 0;
+}
+
+void picoquic_get_cpu_ticks(picoquic_cnx_t* cnx, uint64_t* receive_ticks, uint64_t* prepare_ticks, uint64_t* app_ticks)
+{
+    *receive_ticks = cnx->cpu_ticks_receive;
+    *prepare_ticks = cnx->cpu_ticks_prepare;
+    *app_ticks = cnx->cpu_ticks_app;
+}
+
+/* The application callbacks are called while receiving or preparing packets.
+ * The context keeps the total of the callback ticks, so the callback time
+ * can be subtracted from the enclosing receive or prepare time. */
+void picoquic_cpu_mark(picoquic_quic_t* quic, picoquic_cpu_mark_t* mark)
+{
+    if (quic->is_cpu_accounting_enabled) {
+        mark->ticks = picoquic_cpu_ticks();
+        mark->app_ticks = quic->cpu_ticks_app;
+    }
+    else {
+        mark->ticks = 0;
+        mark->app_ticks = 0;
+    }
+}
+
+uint64_t picoquic_cpu_elapsed(picoquic_quic_t* quic, const picoquic_cpu_mark_t* mark)
+{
+    uint64_t elapsed = 0;
+
+    if (quic->is_cpu_accounting_enabled && mark->ticks != 0) {
+        uint64_t ticks = picoquic_cpu_ticks();
+        uint64_t app_ticks = quic->cpu_ticks_app - mark->app_ticks;
+
+        if (ticks > mark->ticks + app_ticks) {
+            elapsed = ticks - mark->ticks - app_ticks;
+        }
+    }
+
+    return elapsed;
+}
+
+void picoquic_cpu_account_app(picoquic_cnx_t* cnx, const picoquic_cpu_mark_t* mark)
+{
+    uint64_t elapsed = picoquic_cpu_elapsed(cnx->quic, mark);
+
+    cnx->cpu_ticks_app += elapsed;
+    cnx->quic->cpu_ticks_app += elapsed;
+}
+
 /*
 * Get the same time simulation as used for TLS
 */
@@ -4365,12 +6119,39 @@ uint64_t picoquic_current_time()
 uint64_t picoquic_get_quic_time(picoquic_quic_t* quic)
 {
     uint64_t now;
-    if (quic->p_simulated_time == NULL) {
-        now = picoquic_current_time();
+    if (quic->p_simulated_time != NULL) {
+        now = *quic->p_simulated_time;
+    }
+    else if (quic->is_clock_cache_enabled) {
+        now = quic->cached_time;
     }
     else {
-        now = *quic->p_simulated_time;
+        now = picoquic_current_time();
+    }
+
+    return now;
+}
+
+void picoquic_set_clock_cache(picoquic_quic_t* quic, int enable)
+{
+    quic->is_clock_cache_enabled = (enable) ? 1 : 0;
+    if (enable) {
+        (void)picoquic_refresh_quic_time(quic);
+    }
+}
+
+void picoquic_cache_quic_time(picoquic_quic_t* quic, uint64_t current_time)
+{
+    if (current_time > quic->cached_time) {
+        quic->cached_time = current_time;
     }
+}
+
+uint64_t picoquic_refresh_quic_time(picoquic_quic_t* quic)
+{
+    uint64_t now = (quic->p_simulated_time == NULL) ? picoquic_current_time() : *quic->p_simulated_time;
+
+    picoquic_cache_quic_time(quic, now);
 
     return now;
 }
@@ -4417,6 +6198,11 @@ void picoquic_set_packet_train_mode(picoquic_quic_t* quic, int train_mode)
     quic->packet_train_mode = (train_mode > 0) ? 1 : 0;
 }
 
+void picoquic_set_pacing_horizon(picoquic_quic_t* quic, uint64_t horizon_microsec)
+{
+    quic->pacing_horizon_microsec = horizon_microsec;
+}
+
 void picoquic_set_padding_policy(picoquic_quic_t* quic, uint32_t padding_min_size, uint32_t padding_multiple)
 {
     quic->padding_minsize_default = padding_min_size;
@@ -4454,10 +6240,18 @@ uint64_t picoquic_get_default_connection_id_ttl(picoquic_quic_t* quic)
 
 void picoquic_set_mtu_max(picoquic_quic_t* quic, uint32_t mtu_max)
 {
+    if (mtu_max > PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
+        mtu_max = PICOQUIC_MAX_JUMBO_PACKET_SIZE;
+    }
     quic->mtu_max = mtu_max;
     quic->default_tp.max_packet_size = mtu_max;
 }
 
+size_t picoquic_get_max_packet_size(picoquic_quic_t* quic)
+{
+    return (quic->mtu_max > PICOQUIC_MAX_PACKET_SIZE) ? (size_t)quic->mtu_max : PICOQUIC_MAX_PACKET_SIZE;
+}
+
 void picoquic_set_alpn_select_fn(picoquic_quic_t* quic, picoquic_alpn_select_fn alpn_select_fn)
 {
     if (quic->default_alpn != NULL) {
@@ -4507,7 +6301,7 @@ void * picoquic_get_callback_context(picoquic_cnx_t * cnx)
     return cnx->callback_ctx;
 }
 
-picoquic_misc_frame_header_t* picoquic_create_misc_frame(const uint8_t* bytes, size_t length, int is_pure_ack,
+picoquic_misc_frame_header_t* picoquic_create_misc_frame(picoquic_quic_t* quic, const uint8_t* bytes, size_t length, int is_pure_ack,
     picoquic_packet_context_enum pc)
 {
     size_t l_alloc = sizeof(picoquic_misc_frame_header_t) + length;
@@ -4516,9 +6310,8 @@ picoquic_misc_frame_header_t* picoquic_create_misc_frame(const uint8_t* bytes, s
         return NULL;
     }
     else {
-        picoquic_misc_frame_header_t* head = (picoquic_misc_frame_header_t*)malloc(l_alloc);
+        picoquic_misc_frame_header_t* head = picoquic_misc_frame_alloc(quic, length);
         if (head != NULL) {
-            memset(head, 0, sizeof(picoquic_misc_frame_header_t));
             head->length = length;
             head->is_pure_ack = is_pure_ack;
             head->pc = pc;
@@ -4533,11 +6326,13 @@ int picoquic_queue_misc_or_dg_frame(picoquic_cnx_t * cnx, picoquic_misc_frame_he
     picoquic_packet_context_enum pc)
 {
     int ret = 0;
-    picoquic_misc_frame_header_t* misc_frame = picoquic_create_misc_frame(bytes, length, is_pure_ack, pc);
+    picoquic_misc_frame_header_t* misc_frame = picoquic_create_misc_frame(cnx->quic, bytes, length, is_pure_ack, pc);
 
     if (misc_frame == NULL) {
         ret = PICOQUIC_ERROR_MEMORY;
     } else {
+        picoquic_memory_charge(cnx, (first == &cnx->first_datagram) ? picoquic_memory_datagram : picoquic_memory_misc_frame,
+            sizeof(picoquic_misc_frame_header_t) + length);
         if (*last == NULL) {
             *first = misc_frame;
             *last = misc_frame;
@@ -4568,14 +6363,17 @@ void picoquic_purge_misc_frames_after_ready(picoquic_cnx_t* cnx)
         picoquic_misc_frame_header_t* next_frame = misc_frame->next_misc_frame;
 
         if (misc_frame->pc != picoquic_packet_context_application) {
-            picoquic_delete_misc_or_dg(&cnx->first_misc_frame, &cnx->last_misc_frame, misc_frame);
+            picoquic_delete_misc_or_dg(cnx, &cnx->first_misc_frame, &cnx->last_misc_frame, misc_frame);
         }
         misc_frame = next_frame;
     }
 }
 
-void picoquic_delete_misc_or_dg(picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, picoquic_misc_frame_header_t* frame)
+void picoquic_delete_misc_or_dg(picoquic_cnx_t* cnx, picoquic_misc_frame_header_t** first, picoquic_misc_frame_header_t** last, picoquic_misc_frame_header_t* frame)
 {
+    picoquic_memory_discharge(cnx, (first == &cnx->first_datagram) ? picoquic_memory_datagram : picoquic_memory_misc_frame,
+        sizeof(picoquic_misc_frame_header_t) + frame->length);
+
     if (frame->next_misc_frame) {
         frame->next_misc_frame->previous_misc_frame = frame->previous_misc_frame;
     }
@@ -4590,7 +6388,7 @@ void picoquic_delete_misc_or_dg(picoquic_misc_frame_header_t** first, picoquic_m
         *first = frame->next_misc_frame;
     }
 
-    free(frame);
+    picoquic_misc_frame_free(cnx->quic, frame);
 }
 
 void picoquic_clear_ack_ctx(picoquic_ack_context_t* ack_ctx)
@@ -4624,6 +6422,8 @@ void picoquic_reset_packet_context(picoquic_cnx_t* cnx,
     }
 
     pkt_ctx->retransmitted_oldest = NULL;
+    picoquic_packet_index_free(&pkt_ctx->pending_index);
+    picoquic_packet_index_free(&pkt_ctx->retransmitted_index);
 
     /* Reset the ECN data */
     pkt_ctx->ecn_ect0_total_remote = 0;
@@ -4766,13 +6566,32 @@ int picoquic_start_key_rotation(picoquic_cnx_t* cnx)
     return ret;
 }
 
+/* Compute the keys of the next phase ahead of time, so that a key update
+ * initiated by either peer does not run the HKDF and AEAD setup in the
+ * middle of packet processing. Most connections never update their keys,
+ * so this is only done after a first update, or once half of the packets
+ * allowed in the current crypto epoch have been sent.
+ */
+void picoquic_precompute_rotated_keys(picoquic_cnx_t* cnx)
+{
+    if (cnx->cnx_state == picoquic_state_ready &&
+        cnx->crypto_context_new.aead_encrypt == NULL &&
+        cnx->crypto_context_new.aead_decrypt == NULL &&
+        (cnx->nb_crypto_key_rotations > 0 ||
+        cnx->nb_packets_sent - cnx->crypto_epoch_sequence > cnx->crypto_epoch_length_max / 2)) {
+        if (picoquic_compute_new_rotated_keys(cnx) == 0) {
+            cnx->nb_crypto_key_precomputed++;
+        }
+    }
+}
+
 void picoquic_delete_sooner_packets(picoquic_cnx_t* cnx)
 {
     picoquic_stateless_packet_t* packet = cnx->first_sooner;
 
     while (packet != NULL) {
         picoquic_stateless_packet_t* next_packet = packet->next_packet;
-        picoquic_delete_stateless_packet(packet);
+        picoquic_delete_stateless_packet(cnx->quic, packet);
         packet = next_packet;
     }
     cnx->first_sooner = NULL;
@@ -4781,6 +6600,13 @@ void picoquic_delete_sooner_packets(picoquic_cnx_t* cnx)
 void picoquic_delete_cnx(picoquic_cnx_t* cnx)
 {
     if (cnx != NULL) {
+        if (cnx->race_peer != NULL) {
+            /* Deleting one connection of a race also deletes the other one */
+            picoquic_cnx_t* race_peer = cnx->race_peer;
+            cnx->race_peer = NULL;
+            race_peer->race_peer = NULL;
+            picoquic_delete_cnx(race_peer);
+        }
         if (cnx->memlog_call_back != NULL) {
             cnx->memlog_call_back(cnx, NULL, cnx->memlog_ctx, 1, 0);
         }
@@ -4790,6 +6616,8 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
 
         picoquic_log_close_connection(cnx);
 
+        picoquic_careful_resume_save(cnx, picoquic_get_quic_time(cnx->quic));
+
         if (cnx->is_half_open && cnx->quic->current_number_half_open > 0) {
             cnx->quic->current_number_half_open--;
             cnx->is_half_open = 0;
@@ -4816,6 +6644,14 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
         }
 
         picoquic_delete_sooner_packets(cnx);
+        picoquic_ack_batch_forget_cnx(cnx);
+        picoquic_wake_batch_forget_cnx(cnx);
+        picoquic_delivery_batch_forget_cnx(cnx);
+        picoquic_cnx_stats_detach(cnx);
+        picoquic_unpark_handshake(cnx);
+        if (cnx->quic->hp_mask_batch != NULL && cnx->quic->hp_mask_batch->cnx == cnx) {
+            picoquic_clear_header_masks(cnx->quic);
+        }
 
         picoquic_remove_cnx_from_list(cnx);
         picoquic_remove_cnx_from_wake_list(cnx);
@@ -4834,20 +6670,30 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
         }
 
         while (cnx->first_misc_frame != NULL) {
-            picoquic_delete_misc_or_dg(&cnx->first_misc_frame, &cnx->last_misc_frame, cnx->first_misc_frame);
+            picoquic_delete_misc_or_dg(cnx, &cnx->first_misc_frame, &cnx->last_misc_frame, cnx->first_misc_frame);
         }
 
         while (cnx->first_datagram != NULL) {
-            picoquic_delete_misc_or_dg(&cnx->first_datagram, &cnx->last_datagram, cnx->first_datagram);
+            picoquic_delete_misc_or_dg(cnx, &cnx->first_datagram, &cnx->last_datagram, cnx->first_datagram);
         }
 
-        picosplay_empty_tree(&cnx->queue_data_repeat_tree);
+        picoquic_datagram_ring_free(cnx);
+        picoquic_fec_free(cnx);
+
+        while (cnx->data_repeat_first != NULL) {
+            picoquic_dequeue_data_repeat_packet(cnx, cnx->data_repeat_first);
+        }
 
         for (int epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS; epoch++) {
             picoquic_clear_stream(&cnx->tls_stream[epoch]);
         }
 
         picosplay_empty_tree(&cnx->stream_tree);
+        for (int i = 0; i < 4; i++) {
+            picoradix_clear(&cnx->stream_index[i]);
+        }
+        picoquic_release_output_buckets(cnx);
+        cnx->nb_streams_not_indexed = 0;
 
         if (cnx->tls_ctx != NULL) {
             picoquic_tlscontext_free(cnx->tls_ctx, cnx->client_mode);
@@ -4864,6 +6710,7 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
             free(cnx->path);
             cnx->path = NULL;
         }
+        picoradix_clear(&cnx->path_index);
 
         picoquic_delete_local_cnxid_lists(cnx);
         picoquic_delete_remote_cnxid_stashes(cnx);
@@ -4871,7 +6718,14 @@ void picoquic_delete_cnx(picoquic_cnx_t* cnx)
         picoquic_unregister_net_icid(cnx);
         picoquic_unregister_net_secret(cnx);
 
-        free(cnx);
+        if (cnx->memory_used_total > 0) {
+            /* Should not happen if all buffers were released, but keep the context total consistent */
+            DBG_PRINTF("Connection deleted with %" PRIst " bytes still accounted", cnx->memory_used_total);
+            cnx->quic->memory_used_total -= (cnx->quic->memory_used_total > cnx->memory_used_total) ?
+                cnx->memory_used_total : cnx->quic->memory_used_total;
+        }
+
+        picoquic_object_free(cnx->quic, picoquic_object_cnx, cnx);
     }
 }
 
@@ -4938,6 +6792,36 @@ picoquic_cnx_t* picoquic_cnx_by_id(picoquic_quic_t* quic, picoquic_connection_id
     return ret;
 }
 
+/* Variant of picoquic_cnx_by_id for the short header packets. Consecutive
+ * packets usually belong to the same connection, so the local CID of the last
+ * packet is checked before looking up the hash table. The cached value is
+ * reset when that CID is deleted. */
+picoquic_cnx_t* picoquic_cnx_by_id_cached(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id,
+    struct st_picoquic_local_cnxid_t** l_cid)
+{
+    picoquic_cnx_t* ret = NULL;
+    picoquic_local_cnxid_t* last = quic->last_incoming_l_cid;
+
+    if (last != NULL && last->registered_cnx != NULL &&
+        picoquic_compare_connection_id(&last->cnx_id, &cnx_id) == 0) {
+        ret = last->registered_cnx;
+        if (l_cid != NULL) {
+            *l_cid = last;
+        }
+    }
+    else {
+        picoquic_local_cnxid_t* found = NULL;
+
+        ret = picoquic_cnx_by_id(quic, cnx_id, &found);
+        quic->last_incoming_l_cid = found;
+        if (l_cid != NULL) {
+            *l_cid = found;
+        }
+    }
+
+    return ret;
+}
+
 picoquic_cnx_t* picoquic_cnx_by_net(picoquic_quic_t* quic, const struct sockaddr* addr)
 {
     picoquic_cnx_t* ret = NULL;
@@ -5045,6 +6929,11 @@ void picoquic_set_default_congestion_algorithm_by_name(picoquic_quic_t* quic, ch
     picoquic_set_default_congestion_algorithm_ex(quic, picoquic_get_congestion_algorithm(alg_name), NULL);
 }
 
+void picoquic_set_hystart_pp(picoquic_quic_t* quic, int enable)
+{
+    quic->is_hystart_pp_enabled = (enable != 0);
+}
+
 /*
  * Set the optimistic ack policy
  */
@@ -5064,6 +6953,31 @@ void picoquic_set_preemptive_repeat_per_cnx(picoquic_cnx_t* cnx, int do_repeat)
     cnx->is_preemptive_repeat_enabled = (do_repeat) ? 1 : 0;
 }
 
+void picoquic_set_stream_repeat_from_queue_policy(picoquic_quic_t* quic, int from_queue)
+{
+    quic->is_stream_repeat_from_queue = (from_queue) ? 1 : 0;
+}
+
+void picoquic_set_stream_repeat_from_queue(picoquic_cnx_t* cnx, int from_queue)
+{
+    cnx->is_stream_repeat_from_queue = (from_queue) ? 1 : 0;
+}
+
+void picoquic_set_fast_port_rebinding_policy(picoquic_quic_t* quic, int enable)
+{
+    quic->is_fast_port_rebinding = (enable) ? 1 : 0;
+}
+
+void picoquic_set_fast_port_rebinding(picoquic_cnx_t* cnx, int enable)
+{
+    cnx->is_fast_port_rebinding = (enable) ? 1 : 0;
+}
+
+uint64_t picoquic_get_nb_fast_rebindings(picoquic_cnx_t* cnx)
+{
+    return cnx->nb_fast_rebindings;
+}
+
 void picoquic_set_congestion_algorithm_ex(picoquic_cnx_t* cnx, picoquic_congestion_algorithm_t const* alg, char const* alg_option_string)
 {
     if (cnx->congestion_alg != NULL) {
@@ -5091,6 +7005,17 @@ void picoquic_set_congestion_algorithm(picoquic_cnx_t* cnx, picoquic_congestion_
     picoquic_set_congestion_algorithm_ex(cnx, alg, NULL);
 }
 
+void picoquic_set_default_path_scheduler(picoquic_quic_t* quic, picoquic_path_scheduler_t const* scheduler)
+{
+    quic->default_path_scheduler = scheduler;
+}
+
+void picoquic_set_path_scheduler(picoquic_cnx_t* cnx, picoquic_path_scheduler_t const* scheduler)
+{
+    cnx->path_scheduler = scheduler;
+    cnx->is_redundant_repeat_pending = 0;
+}
+
 void picoquic_set_priority_limit_for_bypass(picoquic_cnx_t* cnx, uint8_t priority_limit)
 {
     cnx->priority_limit_for_bypass = priority_limit;
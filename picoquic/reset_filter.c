@@ -0,0 +1,238 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* Prefilter for stateless reset detection.
+ *
+ * Packets that cannot be decrypted are checked against the table of reset
+ * secrets, quic->table_cnx_by_secret. That costs a hash computation and a
+ * table lookup for every undecryptable packet, which adds up under attack
+ * or when many packets arrive for stale CIDs. The prefilter is a cuckoo
+ * filter holding a 16 bit fingerprint of each registered reset secret. The
+ * full lookup only runs if the last 16 bytes of the packet match one of
+ * the fingerprints, which for random garbage happens with a probability of
+ * about 2 * PICOQUIC_RESET_FILTER_BUCKET_SIZE / 65535.
+ *
+ * The reset secrets are unpredictable by design, so the bucket index and
+ * the fingerprint are taken directly from the secret bytes, without hashing.
+ * The filter has no false negatives: if an insertion fails, the filter is
+ * grown and rebuilt from the secrets registered in the connections. If that
+ * is not possible, the filter is disabled and every packet goes through
+ * the full check.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+#define PICOQUIC_RESET_FILTER_BUCKETS_MIN 64
+#define PICOQUIC_RESET_FILTER_MAX_KICKS 128
+
+static size_t picoquic_reset_filter_index(const uint8_t* reset_secret, size_t bucket_mask)
+{
+    return (size_t)PICOPARSE_32(reset_secret) & bucket_mask;
+}
+
+static uint16_t picoquic_reset_filter_fingerprint(const uint8_t* reset_secret)
+{
+    uint16_t fp = PICOPARSE_16(reset_secret + 4);
+    /* Zero marks an empty slot */
+    return (fp == 0) ? 1 : fp;
+}
+
+static size_t picoquic_reset_filter_alt_index(size_t index, uint16_t fp, size_t bucket_mask)
+{
+    return (index ^ ((size_t)fp * 0x5bd1e995u)) & bucket_mask;
+}
+
+static int picoquic_reset_filter_add_to_bucket(picoquic_reset_filter_t* filter, size_t index, uint16_t fp)
+{
+    uint16_t* bucket = filter->fingerprints + index * PICOQUIC_RESET_FILTER_BUCKET_SIZE;
+
+    for (int i = 0; i < PICOQUIC_RESET_FILTER_BUCKET_SIZE; i++) {
+        if (bucket[i] == 0) {
+            bucket[i] = fp;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int picoquic_reset_filter_insert(picoquic_reset_filter_t* filter, const uint8_t* reset_secret)
+{
+    int ret = 0;
+    uint16_t fp = picoquic_reset_filter_fingerprint(reset_secret);
+    size_t i1 = picoquic_reset_filter_index(reset_secret, filter->bucket_mask);
+    size_t i2 = picoquic_reset_filter_alt_index(i1, fp, filter->bucket_mask);
+
+    if (!picoquic_reset_filter_add_to_bucket(filter, i1, fp) &&
+        !picoquic_reset_filter_add_to_bucket(filter, i2, fp)) {
+        /* Relocate fingerprints to their alternate bucket */
+        size_t index = (fp & 1) ? i1 : i2;
+        int kick = 0;
+
+        for (; kick < PICOQUIC_RESET_FILTER_MAX_KICKS; kick++) {
+            uint16_t* slot = filter->fingerprints + index * PICOQUIC_RESET_FILTER_BUCKET_SIZE +
+                (kick % PICOQUIC_RESET_FILTER_BUCKET_SIZE);
+            uint16_t victim = *slot;
+
+            *slot = fp;
+            fp = victim;
+            index = picoquic_reset_filter_alt_index(index, fp, filter->bucket_mask);
+            if (picoquic_reset_filter_add_to_bucket(filter, index, fp)) {
+                break;
+            }
+        }
+        if (kick >= PICOQUIC_RESET_FILTER_MAX_KICKS) {
+            /* One fingerprint was evicted, the filter must be rebuilt */
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        filter->nb_entries++;
+    }
+    return ret;
+}
+
+/* Replace the filter by one of nb_buckets buckets, and insert the
+ * secrets registered by the connections. */
+static int picoquic_reset_filter_rebuild(picoquic_quic_t* quic, size_t nb_buckets)
+{
+    int ret = 0;
+    picoquic_reset_filter_t* filter = &quic->reset_filter;
+    uint16_t* fingerprints = (uint16_t*)malloc(nb_buckets * PICOQUIC_RESET_FILTER_BUCKET_SIZE * sizeof(uint16_t));
+
+    if (fingerprints == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        picoquic_cnx_t* cnx = quic->cnx_list;
+
+        memset(fingerprints, 0, nb_buckets * PICOQUIC_RESET_FILTER_BUCKET_SIZE * sizeof(uint16_t));
+        if (filter->fingerprints != NULL) {
+            free(filter->fingerprints);
+        }
+        filter->fingerprints = fingerprints;
+        filter->bucket_mask = nb_buckets - 1;
+        filter->nb_entries = 0;
+
+        while (ret == 0 && cnx != NULL) {
+            if (cnx->registered_secret_addr.ss_family != 0) {
+                ret = picoquic_reset_filter_insert(filter, cnx->registered_reset_secret);
+            }
+            cnx = cnx->next_in_table;
+        }
+    }
+    return ret;
+}
+
+/* Add the secret registered by a connection, see picoquic_register_net_secret.
+ * The secret must already be copied in cnx->registered_reset_secret. */
+void picoquic_reset_filter_add(picoquic_quic_t* quic, const uint8_t* reset_secret)
+{
+    picoquic_reset_filter_t* filter = &quic->reset_filter;
+
+    if (!filter->is_disabled) {
+        int ret = 0;
+
+        if (filter->fingerprints == NULL) {
+            /* The rebuild inserts the new secret, which is already registered in its connection */
+            ret = picoquic_reset_filter_rebuild(quic, PICOQUIC_RESET_FILTER_BUCKETS_MIN);
+        }
+        else {
+            ret = picoquic_reset_filter_insert(filter, reset_secret);
+        }
+        while (ret == -1) {
+            /* Grow the filter until all the registered secrets fit */
+            ret = picoquic_reset_filter_rebuild(quic, 2 * (filter->bucket_mask + 1));
+        }
+        if (ret != 0) {
+            picoquic_reset_filter_release(quic);
+            filter->is_disabled = 1;
+        }
+    }
+}
+
+void picoquic_reset_filter_remove(picoquic_quic_t* quic, const uint8_t* reset_secret)
+{
+    picoquic_reset_filter_t* filter = &quic->reset_filter;
+
+    if (filter->fingerprints != NULL) {
+        uint16_t fp = picoquic_reset_filter_fingerprint(reset_secret);
+        size_t index[2];
+
+        index[0] = picoquic_reset_filter_index(reset_secret, filter->bucket_mask);
+        index[1] = picoquic_reset_filter_alt_index(index[0], fp, filter->bucket_mask);
+        for (int b = 0; b < 2; b++) {
+            uint16_t* bucket = filter->fingerprints + index[b] * PICOQUIC_RESET_FILTER_BUCKET_SIZE;
+            for (int i = 0; i < PICOQUIC_RESET_FILTER_BUCKET_SIZE; i++) {
+                if (bucket[i] == fp) {
+                    bucket[i] = 0;
+                    filter->nb_entries--;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+int picoquic_reset_filter_check(picoquic_quic_t* quic, const uint8_t* reset_secret)
+{
+    int is_candidate = 0;
+    picoquic_reset_filter_t* filter = &quic->reset_filter;
+
+    if (filter->is_disabled) {
+        is_candidate = 1;
+    }
+    else if (filter->nb_entries > 0) {
+        uint16_t fp = picoquic_reset_filter_fingerprint(reset_secret);
+        size_t i1 = picoquic_reset_filter_index(reset_secret, filter->bucket_mask);
+        size_t i2 = picoquic_reset_filter_alt_index(i1, fp, filter->bucket_mask);
+        uint16_t* b1 = filter->fingerprints + i1 * PICOQUIC_RESET_FILTER_BUCKET_SIZE;
+        uint16_t* b2 = filter->fingerprints + i2 * PICOQUIC_RESET_FILTER_BUCKET_SIZE;
+
+        for (int i = 0; i < PICOQUIC_RESET_FILTER_BUCKET_SIZE; i++) {
+            if (b1[i] == fp || b2[i] == fp) {
+                is_candidate = 1;
+                break;
+            }
+        }
+    }
+    if (!is_candidate) {
+        filter->nb_rejected++;
+    }
+    return is_candidate;
+}
+
+void picoquic_reset_filter_release(picoquic_quic_t* quic)
+{
+    if (quic->reset_filter.fingerprints != NULL) {
+        free(quic->reset_filter.fingerprints);
+        quic->reset_filter.fingerprints = NULL;
+    }
+    quic->reset_filter.bucket_mask = 0;
+    quic->reset_filter.nb_entries = 0;
+}
+
+uint64_t picoquic_get_nb_reset_filter_rejects(picoquic_quic_t* quic)
+{
+    return quic->reset_filter.nb_rejected;
+}
@@ -32,97 +32,162 @@
 * Maintain the list of ACK
 */
 
-/* Procedures to manage the list of ack ranges as a splay
+/* Procedures to manage the list of ack ranges as a sorted array.
+ * Ranges are almost always added or extended at the high end, so
+ * the array is appended in O(1), and the ACK encoder iterates over
+ * contiguous memory. Short lists are kept in the inline items of the
+ * sack list, so that the common case does not allocate memory.
  */
-static void* picoquic_sack_node_value(picosplay_node_t* node)
+static picoquic_sack_item_t* picoquic_sack_items(picoquic_sack_list_t* sack_list)
 {
-    return (void*)((char*)node - offsetof(struct st_picoquic_sack_item_t, node));
+    return (sack_list->items == NULL) ? sack_list->items_inline : sack_list->items;
 }
 
-static picoquic_sack_item_t* picoquic_sack_item_value(picosplay_node_t* node)
+static int picoquic_sack_items_reserve(picoquic_sack_list_t* sack_list, size_t nb_items)
 {
-    return (node == NULL) ? NULL : (picoquic_sack_item_t*)picoquic_sack_node_value(node);
-}
-
-static int64_t picoquic_sack_item_compare(void* l, void* r) {
-    /* ranges are expressed in packet numbers, lower than 2^62,
-     * which implies no risk of integer overflow in 64 bit integers
-     */
-    int64_t delta = ((picoquic_sack_item_t*)l)->start_of_sack_range - ((picoquic_sack_item_t*)r)->start_of_sack_range;
-    return delta;
-}
+    int ret = 0;
+    size_t nb_items_max = (sack_list->items == NULL) ? PICOQUIC_SACK_INLINE_ITEMS : sack_list->nb_items_max;
 
-static picosplay_node_t* picoquic_sack_node_create(void* value)
-{
-    return &((picoquic_sack_item_t*)value)->node;
-}
+    if (nb_items > nb_items_max) {
+        picoquic_sack_item_t* new_items;
+        size_t new_max = 2 * nb_items_max;
 
-static void picoquic_sack_node_delete(void* tree, picosplay_node_t* node)
-{
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(tree);
-#endif
-    free(picoquic_sack_node_value(node));
+        if (new_max < nb_items) {
+            new_max = nb_items;
+        }
+        if (sack_list->items == NULL) {
+            new_items = (picoquic_sack_item_t*)malloc(new_max * sizeof(picoquic_sack_item_t));
+            if (new_items != NULL) {
+                memcpy(new_items, sack_list->items_inline, sack_list->nb_items * sizeof(picoquic_sack_item_t));
+            }
+        }
+        else {
+            new_items = (picoquic_sack_item_t*)realloc(sack_list->items, new_max * sizeof(picoquic_sack_item_t));
+        }
+        if (new_items == NULL) {
+            ret = -1;
+        }
+        else {
+            sack_list->items = new_items;
+            sack_list->nb_items_max = new_max;
+        }
+    }
+    return ret;
 }
 
 /* Return the first ACK item in the list */
 picoquic_sack_item_t* picoquic_sack_first_item(picoquic_sack_list_t* sack_list)
 {
-    return picoquic_sack_item_value(picosplay_first(&sack_list->ack_tree));
+    return (sack_list->nb_items == 0) ? NULL : picoquic_sack_items(sack_list);
 }
 
 picoquic_sack_item_t* picoquic_sack_last_item(picoquic_sack_list_t* sack_list)
 {
-    return picoquic_sack_item_value(picosplay_last(&sack_list->ack_tree));
+    return (sack_list->nb_items == 0) ? NULL : picoquic_sack_items(sack_list) + sack_list->nb_items - 1;
 }
 
-picoquic_sack_item_t* picoquic_sack_next_item(picoquic_sack_item_t* sack)
+picoquic_sack_item_t* picoquic_sack_next_item(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack)
 {
-    return picoquic_sack_item_value(picosplay_next(&sack->node));
+    return (sack + 1 < picoquic_sack_items(sack_list) + sack_list->nb_items) ? sack + 1 : NULL;
 }
 
-picoquic_sack_item_t* picoquic_sack_previous_item(picoquic_sack_item_t* sack)
+picoquic_sack_item_t* picoquic_sack_previous_item(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack)
 {
-    return picoquic_sack_item_value(picosplay_previous(&sack->node));
+    return (sack > picoquic_sack_items(sack_list)) ? sack - 1 : NULL;
+}
+
+/* Find the index of the last range starting at or below pn64, or -1 if there is none.
+ * The highest range is checked first, since this covers in order arrivals.
+ */
+static int64_t picoquic_sack_find_index_below(picoquic_sack_list_t* sack_list, uint64_t pn64)
+{
+    picoquic_sack_item_t* items = picoquic_sack_items(sack_list);
+    int64_t index = -1;
+
+    if (sack_list->nb_items > 0) {
+        if (items[sack_list->nb_items - 1].start_of_sack_range <= pn64) {
+            index = (int64_t)sack_list->nb_items - 1;
+        }
+        else if (items[0].start_of_sack_range <= pn64) {
+            size_t low = 0;
+            size_t high = sack_list->nb_items - 1;
+            /* Invariant: items[low].start <= pn64 < items[high].start */
+            while (low + 1 < high) {
+                size_t middle = (low + high) / 2;
+                if (items[middle].start_of_sack_range <= pn64) {
+                    low = middle;
+                }
+                else {
+                    high = middle;
+                }
+            }
+            index = (int64_t)low;
+        }
+    }
+    return index;
 }
 
 int picoquic_sack_insert_item(picoquic_sack_list_t* sack_list, uint64_t range_min, uint64_t range_max, uint64_t current_time)
 {
     int ret = 0;
-    picoquic_sack_item_t* sack_new = (picoquic_sack_item_t*)malloc(sizeof(picoquic_sack_item_t));
-    if (sack_new == NULL) {
+
+    if (picoquic_sack_items_reserve(sack_list, sack_list->nb_items + 1) != 0) {
         ret = -1;
     }
     else
     {
+        picoquic_sack_item_t* items = picoquic_sack_items(sack_list);
+        size_t index = (size_t)(picoquic_sack_find_index_below(sack_list, range_min) + 1);
+        picoquic_sack_item_t* sack_new = &items[index];
+
+        if (index < sack_list->nb_items) {
+            memmove(sack_new + 1, sack_new, (sack_list->nb_items - index) * sizeof(picoquic_sack_item_t));
+        }
+        sack_list->nb_items++;
         memset(sack_new, 0, sizeof(picoquic_sack_item_t));
         sack_new->start_of_sack_range = range_min;
         sack_new->end_of_sack_range = range_max;
         sack_new->time_created = current_time;
         sack_list->rc[0].range_counts[0] += 1;
         sack_list->rc[1].range_counts[0] += 1;
-        (void)picosplay_insert(&sack_list->ack_tree, sack_new);
+        for (int r = 0; r < 2; r++) {
+            if (range_min < sack_list->ack_scan_floor[r]) {
+                sack_list->ack_scan_floor[r] = range_min;
+            }
+        }
     }
 
     return ret;
 }
-void picoquic_sack_delete_item(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack)
+
+/* Accounting of deleted values */
+static void picoquic_sack_item_discount(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack)
 {
-    /* Accounting of deleted values */
     for (int r = 0; r < 2; r++) {
         if (sack->nb_times_sent[r] < PICOQUIC_MAX_ACK_RANGE_REPEAT) {
             sack_list->rc[r].range_counts[sack->nb_times_sent[r]] -= 1;
         }
     }
-    /* Delete the item in the splay */
-    picosplay_delete_hint(&sack_list->ack_tree, &sack->node);
+}
+
+/* Delete an item. Pointers to the items that follow it are invalidated.
+ */
+void picoquic_sack_delete_item(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* sack)
+{
+    picoquic_sack_item_t* items_end = picoquic_sack_items(sack_list) + sack_list->nb_items;
+
+    picoquic_sack_item_discount(sack_list, sack);
+    if (sack + 1 < items_end) {
+        memmove(sack, sack + 1, (items_end - sack - 1) * sizeof(picoquic_sack_item_t));
+    }
+    sack_list->nb_items--;
 }
 
 /* Check whether the sack list is empty
  */
 int picoquic_sack_list_is_empty(picoquic_sack_list_t* sack_list)
 {
-    return (sack_list->ack_tree.size == 0);
+    return (sack_list->nb_items == 0);
 }
 
 /* Find the ack context from the context 
@@ -158,19 +223,18 @@ picoquic_sack_list_t* picoquic_sack_list_from_cnx_context(picoquic_cnx_t* cnx,
 picoquic_sack_item_t* picoquic_sack_find_range_below_number(picoquic_sack_list_t* sack_list, picoquic_sack_item_t* previous,
     uint64_t pn64)
 {
+    int64_t index;
 #ifdef _WINDOWS
     UNREFERENCED_PARAMETER(previous);
 #endif
-    picoquic_sack_item_t v = { 0 };
-    v.start_of_sack_range = pn64;
-    v.end_of_sack_range = pn64;
-    return(picoquic_sack_item_value(picosplay_find_previous(&sack_list->ack_tree, &v)));
+    index = picoquic_sack_find_index_below(sack_list, pn64);
+    return (index < 0) ? NULL : picoquic_sack_items(sack_list) + index;
 }
 
 /*
  * Check whether the packet was already received.
- * If using the "horizon", then consider already received all packets 
- * at or below the horizon.
+ * Consider already received all packets below the horizon, which
+ * is raised when the lowest ranges are removed from the list.
  */
 int picoquic_is_pn_already_received(picoquic_cnx_t* cnx, 
     picoquic_packet_context_enum pc, picoquic_local_cnxid_t * l_cid, uint64_t pn64)
@@ -178,7 +242,7 @@ int picoquic_is_pn_already_received(picoquic_cnx_t* cnx,
     int is_received = 0;
     picoquic_sack_list_t* sack_list = picoquic_sack_list_from_cnx_context(cnx, pc, l_cid);
 
-    if (sack_list->horizon_delay > 0 && pn64 < sack_list->ack_horizon) {
+    if (pn64 < sack_list->ack_horizon) {
         is_received = 1;
     }
     else {
@@ -203,7 +267,7 @@ int picoquic_update_sack_list(picoquic_sack_list_t* sack_list,
     if (previous == NULL || previous->end_of_sack_range + 1 < pn64_min) {
         /* No overlap with a range below */
         picoquic_sack_item_t* next = (previous == NULL) ?
-            picoquic_sack_first_item(sack_list) : picoquic_sack_next_item(previous);
+            picoquic_sack_first_item(sack_list) : picoquic_sack_next_item(sack_list, previous);
         if (next == NULL || next->start_of_sack_range - 1 > pn64_max) {
             /* create a new item in the list */
             ret = picoquic_sack_insert_item(sack_list, pn64_min, pn64_max, current_time);
@@ -224,7 +288,7 @@ int picoquic_update_sack_list(picoquic_sack_list_t* sack_list,
     while (previous != NULL && previous->end_of_sack_range < pn64_max) {
         /* we found or created an item that includes the beginning
          * of the acked range. Check the next one */
-        picoquic_sack_item_t* next = picoquic_sack_next_item(previous);
+        picoquic_sack_item_t* next = picoquic_sack_next_item(sack_list, previous);
         if (next == NULL || next->start_of_sack_range - 1 > pn64_max) {
             /* No overlap. Extend the previous item up to the max of the range */
             previous->end_of_sack_range = pn64_max;
@@ -289,6 +353,7 @@ int picoquic_record_pn_received(picoquic_cnx_t* cnx,
         }
 
         ret = picoquic_update_sack_list(sack_list, pn64, pn64, current_microsec);
+        picoquic_sack_list_compact(sack_list, PICOQUIC_MAX_ACK_RANGES_TRACKED);
     }
     return ret;
 }
@@ -351,7 +416,7 @@ picoquic_sack_item_t* picoquic_process_ack_of_ack_range(picoquic_sack_list_t* sa
     previous = picoquic_sack_find_range_below_number(sack_list, NULL, start_of_range);
 
     if (previous != NULL && previous->start_of_sack_range == start_of_range){
-        picoquic_sack_item_t* next = picoquic_sack_item_value(picosplay_next(&previous->node));
+        picoquic_sack_item_t* next = picoquic_sack_next_item(sack_list, previous);
         if (next == NULL) {
             /* Matching the highest range, which shall not be deleted */
             if (end_of_range < previous->end_of_sack_range) {
@@ -383,27 +448,70 @@ picoquic_sack_item_t* picoquic_process_ack_of_ack_range(picoquic_sack_list_t* sa
  */
 void picoquic_update_ack_horizon(picoquic_sack_list_t* sack_list, uint64_t current_time)
 {
-    picoquic_sack_item_t* first_sack = picoquic_sack_first_item(sack_list);
+    picoquic_sack_item_t* items = picoquic_sack_items(sack_list);
+    size_t nb_deleted = 0;
 
-    while (first_sack != NULL && first_sack->nb_times_sent[0] >= PICOQUIC_MAX_ACK_RANGE_REPEAT) {
-        int64_t delay = current_time - first_sack->time_created;
+    /* Always keep the last range */
+    while (nb_deleted + 1 < sack_list->nb_items &&
+        items[nb_deleted].nb_times_sent[0] >= PICOQUIC_MAX_ACK_RANGE_REPEAT) {
+        int64_t delay = current_time - items[nb_deleted].time_created;
         if (delay > sack_list->horizon_delay) {
-            picoquic_sack_item_t* next_sack = picoquic_sack_next_item(first_sack);
-            if (next_sack != NULL) {
-                /* Always keep the last range */
-                sack_list->ack_horizon = first_sack->end_of_sack_range + 1;
-                picoquic_sack_delete_item(sack_list, first_sack);
-            }
-            first_sack = next_sack;
+            sack_list->ack_horizon = items[nb_deleted].end_of_sack_range + 1;
+            picoquic_sack_item_discount(sack_list, &items[nb_deleted]);
+            nb_deleted++;
         }
         else {
             break;
         }
     }
+    if (nb_deleted > 0) {
+        /* Remove all the expired ranges in a single move */
+        sack_list->nb_items -= nb_deleted;
+        memmove(items, items + nb_deleted, sack_list->nb_items * sizeof(picoquic_sack_item_t));
+    }
 }
 
 
 
+/* Bound the number of ranges tracked for received packet numbers. Ranges
+ * are only removed when the peer acknowledges an ACK that carried exactly
+ * that range, so on long lived connections with many losses they would keep
+ * accumulating, increasing the cost of inserting and pruning ranges. When
+ * the list grows above the cap, the lowest ranges are removed in a single
+ * move, down to 7/8th of the cap so the cost is amortized, and the horizon
+ * is raised above them: the packets below it are considered received.
+ * Only the ranges already sent PICOQUIC_MIN_ACK_RANGE_REPEAT times in ACK
+ * frames are removed, so the peer has a chance to learn about them: the
+ * list may stay above the cap until the lowest ones have been sent.
+ */
+void picoquic_sack_list_compact(picoquic_sack_list_t* sack_list, size_t nb_ranges_max)
+{
+    if (sack_list->nb_items > nb_ranges_max) {
+        picoquic_sack_item_t* items = picoquic_sack_items(sack_list);
+        size_t nb_kept = nb_ranges_max - nb_ranges_max / 8;
+        size_t nb_deletable;
+        size_t nb_deleted = 0;
+
+        if (nb_kept == 0) {
+            /* Always keep the last range */
+            nb_kept = 1;
+        }
+        nb_deletable = sack_list->nb_items - nb_kept;
+        while (nb_deleted < nb_deletable &&
+            items[nb_deleted].nb_times_sent[0] >= PICOQUIC_MIN_ACK_RANGE_REPEAT) {
+            picoquic_sack_item_discount(sack_list, &items[nb_deleted]);
+            nb_deleted++;
+        }
+        if (nb_deleted > 0) {
+            if (items[nb_deleted - 1].end_of_sack_range + 1 > sack_list->ack_horizon) {
+                sack_list->ack_horizon = items[nb_deleted - 1].end_of_sack_range + 1;
+            }
+            sack_list->nb_items -= nb_deleted;
+            memmove(items, items + nb_deleted, sack_list->nb_items * sizeof(picoquic_sack_item_t));
+        }
+    }
+}
+
 /* Return the first element of a sack list */
 uint64_t picoquic_sack_list_first(picoquic_sack_list_t* sack_list)
 {
@@ -424,7 +532,7 @@ uint64_t picoquic_sack_list_last(picoquic_sack_list_t* sack_list)
 picoquic_sack_item_t * picoquic_sack_list_first_range(picoquic_sack_list_t* sack_list)
 {
     picoquic_sack_item_t* first = picoquic_sack_first_item(sack_list);
-    return(first == NULL) ? NULL : picoquic_sack_item_value(picosplay_next(&first->node));
+    return(first == NULL) ? NULL : picoquic_sack_next_item(sack_list, first);
 }
 
 /* Initialize a sack list
@@ -432,8 +540,6 @@ picoquic_sack_item_t * picoquic_sack_list_first_range(picoquic_sack_list_t* sack
 void picoquic_sack_list_init(picoquic_sack_list_t* sack_list)
 {
     memset(sack_list, 0, sizeof(picoquic_sack_list_t));
-    picosplay_init_tree(&sack_list->ack_tree, picoquic_sack_item_compare,
-        picoquic_sack_node_create, picoquic_sack_node_delete, picoquic_sack_node_value);
 }
 
 /* Reset a SACK list to single range
@@ -450,9 +556,15 @@ int picoquic_sack_list_reset(picoquic_sack_list_t* sack_list, uint64_t range_min
  */
 void picoquic_sack_list_free(picoquic_sack_list_t* sack_list)
 {
-    picosplay_empty_tree(&sack_list->ack_tree);
+    if (sack_list->items != NULL) {
+        free(sack_list->items);
+        sack_list->items = NULL;
+    }
+    sack_list->nb_items = 0;
+    sack_list->nb_items_max = 0;
     for (int r = 0; r < 2; r++) {
         memset(sack_list->rc[r].range_counts, 0, sizeof(sack_list->rc[r].range_counts));
+        sack_list->ack_scan_floor[r] = 0;
     }
 }
 
@@ -492,10 +604,13 @@ void picoquic_sack_item_record_reset(picoquic_sack_list_t* sack_list, picoquic_s
         }
         sack_item->nb_times_sent[r] = 0;
         sack_list->rc[r].range_counts[sack_item->nb_times_sent[r]] += 1;
+        if (sack_item->start_of_sack_range < sack_list->ack_scan_floor[r]) {
+            sack_list->ack_scan_floor[r] = sack_item->start_of_sack_range;
+        }
     }
 }
 
 size_t picoquic_sack_list_size(picoquic_sack_list_t* sack_list)
 {
-    return (size_t)sack_list->ack_tree.size;
+    return sack_list->nb_items;
 }
\ No newline at end of file
@@ -22,6 +22,7 @@
 #include "picoquic_internal.h"
 #include "picoquic_unified_log.h"
 #include "tls_api.h"
+#include "picoquic_probes.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -208,12 +209,283 @@ int picoquic_mark_high_priority_stream(picoquic_cnx_t * cnx, uint64_t stream_id,
     return ret;
 }
 
-int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
-    const uint8_t* data, size_t length, int set_fin, void * app_stream_ctx)
+/* Write coalescing. The cork node is a queue node with inline bytes,
+ * allocated with spare capacity and kept out of the send queue until it
+ * is flushed. Memory is charged when the node joins the send queue. */
+static int picoquic_cork_append(picoquic_stream_head_t* stream, const picoquic_iovec_t* iov, size_t nb_iov, size_t length)
+{
+    int ret = 0;
+    size_t cork_length = (stream->cork_node == NULL) ? 0 : stream->cork_node->length;
+
+    if (length > stream->cork_capacity - cork_length) {
+        size_t capacity = (stream->cork_capacity == 0) ? PICOQUIC_CORK_INITIAL_SIZE : stream->cork_capacity;
+        picoquic_stream_queue_node_t* node;
+
+        while (capacity < cork_length + length) {
+            capacity *= 2;
+        }
+        if ((node = (picoquic_stream_queue_node_t*)realloc(stream->cork_node,
+            sizeof(picoquic_stream_queue_node_t) + capacity)) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            if (stream->cork_node == NULL) {
+                memset(node, 0, sizeof(picoquic_stream_queue_node_t));
+            }
+            node->bytes = PICOQUIC_STREAM_QUEUE_NODE_INLINE_BYTES(node);
+            stream->cork_node = node;
+            stream->cork_capacity = capacity;
+        }
+    }
+
+    if (ret == 0) {
+        for (size_t i = 0; i < nb_iov; i++) {
+            if (iov[i].len > 0) {
+                memcpy(stream->cork_node->bytes + stream->cork_node->length, iov[i].base, iov[i].len);
+                stream->cork_node->length += iov[i].len;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static void picoquic_cork_flush(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    picoquic_stream_queue_node_t* node = stream->cork_node;
+
+    if (node != NULL) {
+        stream->cork_node = NULL;
+        stream->cork_capacity = 0;
+        if (stream->reset_requested || stream->reset_sent) {
+            /* The data will never be sent */
+            free(node);
+        }
+        else {
+            picoquic_stream_queue_node_t** pprevious = &stream->send_queue;
+
+            picoquic_memory_charge(cnx, picoquic_memory_stream_send, PICOQUIC_STREAM_QUEUE_NODE_CHARGE(node));
+            while (*pprevious != NULL) {
+                pprevious = &(*pprevious)->next_stream_data;
+            }
+            *pprevious = node;
+            picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+        }
+    }
+}
+
+int picoquic_cork_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
+
+    if (ret == 0) {
+        stream->is_corked = 1;
+    }
+
+    return ret;
+}
+
+int picoquic_uncork_stream(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+    if (stream == NULL) {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else {
+        stream->is_corked = 0;
+        if (!cnx->is_corked) {
+            picoquic_cork_flush(cnx, stream);
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_cork_cnx(picoquic_cnx_t* cnx)
+{
+    cnx->is_corked = 1;
+}
+
+void picoquic_uncork_cnx(picoquic_cnx_t* cnx)
+{
+    picoquic_stream_head_t* stream = picoquic_first_stream(cnx);
+
+    cnx->is_corked = 0;
+    while (stream != NULL) {
+        if (!stream->is_corked) {
+            picoquic_cork_flush(cnx, stream);
+        }
+        stream = picoquic_next_stream(stream);
+    }
+}
+
+/* Send backlog watermarks. The events are only issued when the backlog
+ * crosses a watermark, so the cost per queued or sent chunk is a couple of
+ * comparisons. */
+static void picoquic_send_backlog_signal(picoquic_cnx_t* cnx, uint64_t stream_id, void* v_stream_ctx,
+    picoquic_call_back_event_t event, uint64_t backlog)
+{
+    if (cnx->callback_fn != NULL &&
+        cnx->callback_fn(cnx, stream_id, NULL, (size_t)backlog, event, cnx->callback_ctx, v_stream_ctx) != 0) {
+        picoquic_log_app_message(cnx, "Send backlog callback returns error 0x%x", PICOQUIC_TRANSPORT_INTERNAL_ERROR);
+        (void)picoquic_connection_error(cnx, PICOQUIC_TRANSPORT_INTERNAL_ERROR, 0);
+    }
+}
+
+static void picoquic_send_backlog_check_cnx(picoquic_cnx_t* cnx)
+{
+    if (cnx->backlog_high != 0) {
+        if (!cnx->is_backlog_high && cnx->send_backlog >= cnx->backlog_high) {
+            cnx->is_backlog_high = 1;
+            picoquic_send_backlog_signal(cnx, UINT64_MAX, NULL, picoquic_callback_send_backlog_high, cnx->send_backlog);
+        }
+        else if (cnx->is_backlog_high && cnx->send_backlog <= cnx->backlog_low) {
+            cnx->is_backlog_high = 0;
+            picoquic_send_backlog_signal(cnx, UINT64_MAX, NULL, picoquic_callback_send_backlog_low, cnx->send_backlog);
+        }
+    }
+}
+
+static void picoquic_send_backlog_check(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    if (stream->backlog_high != 0) {
+        if (!stream->is_backlog_high && stream->send_backlog >= stream->backlog_high) {
+            stream->is_backlog_high = 1;
+            picoquic_send_backlog_signal(cnx, stream->stream_id, stream->app_stream_ctx,
+                picoquic_callback_send_backlog_high, stream->send_backlog);
+        }
+        else if (stream->is_backlog_high && stream->send_backlog <= stream->backlog_low) {
+            stream->is_backlog_high = 0;
+            picoquic_send_backlog_signal(cnx, stream->stream_id, stream->app_stream_ctx,
+                picoquic_callback_send_backlog_low, stream->send_backlog);
+        }
+    }
+    picoquic_send_backlog_check_cnx(cnx);
+}
+
+void picoquic_send_backlog_add(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint64_t length)
+{
+    stream->send_backlog += length;
+    cnx->send_backlog += length;
+    picoquic_send_backlog_check(cnx, stream);
+}
+
+void picoquic_send_backlog_remove(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream, uint64_t length)
+{
+    if (length > stream->send_backlog) {
+        length = stream->send_backlog;
+    }
+    stream->send_backlog -= length;
+    cnx->send_backlog -= length;
+    picoquic_send_backlog_check(cnx, stream);
+}
+
+void picoquic_send_backlog_discard(picoquic_cnx_t* cnx, picoquic_stream_head_t* stream)
+{
+    cnx->send_backlog -= stream->send_backlog;
+    stream->send_backlog = 0;
+    stream->is_backlog_high = 0;
+    picoquic_send_backlog_check_cnx(cnx);
+}
+
+int picoquic_set_send_backlog_watermarks(picoquic_cnx_t* cnx, uint64_t high, uint64_t low)
+{
+    int ret = 0;
+
+    if (high != 0 && low >= high) {
+        ret = -1;
+    }
+    else {
+        cnx->backlog_high = high;
+        cnx->backlog_low = low;
+        cnx->is_backlog_high = 0;
+        picoquic_send_backlog_check_cnx(cnx);
+    }
+
+    return ret;
+}
+
+int picoquic_set_stream_send_backlog_watermarks(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t high, uint64_t low)
 {
     int ret = 0;
+    picoquic_stream_head_t* stream = NULL;
+
+    if (high != 0 && low >= high) {
+        ret = -1;
+    }
+    else if ((stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret)) != NULL && ret == 0) {
+        stream->backlog_high = high;
+        stream->backlog_low = low;
+        stream->is_backlog_high = 0;
+        picoquic_send_backlog_check(cnx, stream);
+    }
+
+    return ret;
+}
+
+uint64_t picoquic_get_send_backlog(picoquic_cnx_t* cnx)
+{
+    return cnx->send_backlog;
+}
+
+uint64_t picoquic_get_stream_send_backlog(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+    return (stream == NULL) ? 0 : stream->send_backlog;
+}
+
+uint64_t picoquic_get_send_headroom(picoquic_cnx_t* cnx, uint64_t stream_id)
+{
+    uint64_t headroom = 0;
+    picoquic_path_t* path_x = cnx->path[0];
+
+    if (path_x->cwin > path_x->bytes_in_transit && cnx->maxdata_remote > cnx->data_sent) {
+        headroom = path_x->cwin - path_x->bytes_in_transit;
+        if (cnx->maxdata_remote - cnx->data_sent < headroom) {
+            headroom = cnx->maxdata_remote - cnx->data_sent;
+        }
+        if (stream_id != UINT64_MAX) {
+            picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+            if (stream == NULL || stream->maxdata_remote <= stream->sent_offset) {
+                headroom = 0;
+            }
+            else if (stream->maxdata_remote - stream->sent_offset < headroom) {
+                headroom = stream->maxdata_remote - stream->sent_offset;
+            }
+        }
+    }
+
+    return headroom;
+}
+
+/* Queue data on a stream. If release_fn is NULL, the segments are copied
+ * in a single buffer, allocated with the queue node. Otherwise, there is at
+ * most one segment, the queue node refers to the application data, and
+ * release_fn is called when the node is freed. */
+static int picoquic_add_to_stream_ex(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const picoquic_iovec_t* iov, size_t nb_iov, int set_fin, void * app_stream_ctx,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
+{
+    int ret = 0;
+    int is_corked = 0;
+    size_t length = 0;
     picoquic_stream_head_t* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
 
+    for (size_t i = 0; ret == 0 && i < nb_iov; i++) {
+        if (iov[i].len > SIZE_MAX - sizeof(picoquic_stream_queue_node_t) - length ||
+            (iov[i].len > 0 && iov[i].base == NULL)) {
+            ret = -1;
+        }
+        else {
+            length += iov[i].len;
+        }
+    }
+
     if (ret == 0 && set_fin) {
         if (stream->fin_requested) {
             /* app error, notified the fin twice*/
@@ -230,34 +502,60 @@ int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
         ret = -1;
     }
 
-    if (ret == 0 && length > 0) {
+    if (ret == 0) {
+        /* Copied data is coalesced while corked. The FIN, zero copy data, or
+         * reaching the threshold flush the coalesced data first, so the
+         * stream order is preserved. */
+        is_corked = (release_fn == NULL && !set_fin && (stream->is_corked || cnx->is_corked) &&
+            length < PICOQUIC_CORK_THRESHOLD);
+        if (stream->cork_node != NULL &&
+            (!is_corked || length > PICOQUIC_CORK_THRESHOLD - stream->cork_node->length)) {
+            picoquic_cork_flush(cnx, stream);
+        }
+    }
+
+    if (ret == 0 && length > 0 && is_corked) {
+        if ((ret = picoquic_cork_append(stream, iov, nb_iov, length)) == 0 &&
+            stream->cork_node->length >= PICOQUIC_CORK_THRESHOLD) {
+            picoquic_cork_flush(cnx, stream);
+        }
+    }
+    else if (ret == 0 && length > 0) {
         picoquic_stream_queue_node_t* stream_data = (picoquic_stream_queue_node_t*)
-            malloc(sizeof(picoquic_stream_queue_node_t));
+            malloc(sizeof(picoquic_stream_queue_node_t) + ((release_fn == NULL) ? length : 0));
         if (stream_data == 0) {
             ret = -1;
         } else {
-            stream_data->bytes = (uint8_t*)malloc(length);
+            picoquic_stream_queue_node_t** pprevious = &stream->send_queue;
+            picoquic_stream_queue_node_t* next = stream->send_queue;
 
-            if (stream_data->bytes == NULL) {
-                free(stream_data);
-                stream_data = NULL;
-                ret = -1;
-            } else {
-                picoquic_stream_queue_node_t** pprevious = &stream->send_queue;
-                picoquic_stream_queue_node_t* next = stream->send_queue;
-
-                memcpy(stream_data->bytes, data, length);
-                stream_data->length = length;
-                stream_data->offset = 0;
-                stream_data->next_stream_data = NULL;
-
-                while (next != NULL) {
-                    pprevious = &next->next_stream_data;
-                    next = next->next_stream_data;
-                }
+            stream_data->release_fn = release_fn;
+            stream_data->release_ctx = release_ctx;
+            if (release_fn != NULL) {
+                stream_data->bytes = (uint8_t*)iov[0].base;
+            }
+            else {
+                size_t copied = 0;
 
-                *pprevious = stream_data;
+                stream_data->bytes = PICOQUIC_STREAM_QUEUE_NODE_INLINE_BYTES(stream_data);
+                for (size_t i = 0; i < nb_iov; i++) {
+                    if (iov[i].len > 0) {
+                        memcpy(stream_data->bytes + copied, iov[i].base, iov[i].len);
+                        copied += iov[i].len;
+                    }
+                }
             }
+            stream_data->length = length;
+            stream_data->offset = 0;
+            stream_data->next_stream_data = NULL;
+            picoquic_memory_charge(cnx, picoquic_memory_stream_send, PICOQUIC_STREAM_QUEUE_NODE_CHARGE(stream_data));
+
+            while (next != NULL) {
+                pprevious = &next->next_stream_data;
+                next = next->next_stream_data;
+            }
+
+            *pprevious = stream_data;
         }
 
         picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
@@ -267,6 +565,105 @@ int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
         cnx->nb_bytes_queued += length;
         stream->is_active = 0;
         stream->app_stream_ctx = app_stream_ctx;
+        if (length > 0) {
+            picoquic_send_backlog_add(cnx, stream, length);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_add_to_stream_with_ctx(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void * app_stream_ctx)
+{
+    picoquic_iovec_t iov;
+
+    iov.base = data;
+    iov.len = length;
+
+    return picoquic_add_to_stream_ex(cnx, stream_id, &iov, 1, set_fin, app_stream_ctx, NULL, NULL);
+}
+
+int picoquic_add_to_stream_iov(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const picoquic_iovec_t* iov, size_t nb_iov, int set_fin, void* app_stream_ctx)
+{
+    return picoquic_add_to_stream_ex(cnx, stream_id, iov, nb_iov, set_fin, app_stream_ctx, NULL, NULL);
+}
+
+int picoquic_set_stream_deadline(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t deadline, uint64_t expiry_error)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
+
+    if (ret == 0) {
+        stream->deadline = deadline;
+        stream->deadline_error = expiry_error;
+        picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+    }
+
+    return ret;
+}
+
+int picoquic_add_to_stream_with_deadline(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx, uint64_t deadline)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream_for_writing(cnx, stream_id, &ret);
+    uint64_t start_offset = 0;
+
+    if (ret == 0) {
+        picoquic_stream_queue_node_t* next = stream->send_queue;
+
+        start_offset = stream->sent_offset;
+        while (next != NULL) {
+            start_offset += next->length - next->offset;
+            next = next->next_stream_data;
+        }
+        if (stream->cork_node != NULL) {
+            start_offset += stream->cork_node->length;
+        }
+        ret = picoquic_add_to_stream_with_ctx(cnx, stream_id, data, length, set_fin, app_stream_ctx);
+    }
+
+    if (ret == 0 && length > 0 && deadline != 0) {
+        picoquic_stream_deadline_t* range = (picoquic_stream_deadline_t*)malloc(sizeof(picoquic_stream_deadline_t));
+
+        if (range == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            range->next_deadline = NULL;
+            range->start_offset = start_offset;
+            range->end_offset = start_offset + length;
+            range->deadline = deadline;
+            if (stream->last_deadline == NULL) {
+                stream->first_deadline = range;
+            }
+            else {
+                stream->last_deadline->next_deadline = range;
+            }
+            stream->last_deadline = range;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_add_to_stream_zero_copy(picoquic_cnx_t* cnx, uint64_t stream_id,
+    const uint8_t* data, size_t length, int set_fin, void* app_stream_ctx,
+    picoquic_stream_data_release_fn release_fn, void* release_ctx)
+{
+    int ret;
+    picoquic_iovec_t iov;
+
+    iov.base = data;
+    iov.len = length;
+
+    if (release_fn == NULL && length > 0) {
+        ret = -1;
+    }
+    else {
+        ret = picoquic_add_to_stream_ex(cnx, stream_id, &iov, 1, set_fin, app_stream_ctx, release_fn, release_ctx);
     }
 
     return ret;
@@ -300,6 +697,11 @@ int picoquic_open_flow_control(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t
             int more_data = 0;
             int is_pure_ack = 1;
 
+            if (stream->reassembly_ring != NULL && expected_data_size > stream->reassembly_ring->size) {
+                /* The peer cannot be allowed to send beyond the ring window */
+                max_required = stream->consumed_offset + stream->reassembly_ring->size;
+            }
+
             if (max_required > stream->maxdata_local) {
                 uint8_t* bytes_next = picoquic_format_max_stream_data_frame(cnx, stream, buffer + consumed, bytes_max, &more_data, &is_pure_ack, max_required);
                 bytes_next = picoquic_format_max_data_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack, expected_data_size);
@@ -314,6 +716,48 @@ int picoquic_open_flow_control(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t
     return ret;
 }
 
+int picoquic_stream_data_consumed(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t consumed_offset)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+    if (stream == NULL || !stream->is_app_flow_controlled) {
+        ret = PICOQUIC_ERROR_INVALID_STREAM_ID;
+    }
+    else {
+        uint64_t new_max_data;
+
+        if (consumed_offset > stream->consumed_offset) {
+            consumed_offset = stream->consumed_offset;
+        }
+        stream->app_consumed_offset = consumed_offset;
+
+        if (!stream->fin_received && !stream->reset_received &&
+            (new_max_data = picoquic_stream_new_max_data(cnx, stream)) != 0) {
+            if (cnx->cnx_state == picoquic_state_ready) {
+                /* Send the update now, as the peer may be blocked waiting for it */
+                uint8_t buffer[32];
+                uint8_t* bytes_next;
+                int more_data = 0;
+                int is_pure_ack = 1;
+
+                bytes_next = picoquic_format_max_stream_data_frame(cnx, stream, buffer, buffer + sizeof(buffer),
+                    &more_data, &is_pure_ack, new_max_data);
+                if (bytes_next > buffer) {
+                    ret = picoquic_queue_misc_frame(cnx, buffer, bytes_next - buffer, is_pure_ack,
+                        picoquic_packet_context_application);
+                }
+            }
+            else {
+                cnx->max_stream_data_needed = 1;
+            }
+            picoquic_reinsert_by_wake_time(cnx->quic, cnx, picoquic_get_quic_time(cnx->quic));
+        }
+    }
+
+    return ret;
+}
+
 void picoquic_reset_stream_ctx(picoquic_cnx_t* cnx, uint64_t stream_id)
 {
     picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
@@ -341,6 +785,7 @@ int picoquic_reset_stream(picoquic_cnx_t* cnx,
         else if (!stream->reset_requested) {
             stream->local_error = local_stream_error;
             stream->reset_requested = 1;
+            picoquic_promote_output_stream(cnx, stream);
         }
     }
 
@@ -384,6 +829,7 @@ int picoquic_stop_sending(picoquic_cnx_t* cnx,
             stream->local_stop_error = local_stream_error;
             stream->stop_sending_requested = 1;
             picoquic_insert_output_stream(cnx, stream);
+            picoquic_promote_output_stream(cnx, stream);
         }
     }
 
@@ -464,12 +910,22 @@ size_t picoquic_pad_to_policy(picoquic_cnx_t * cnx, uint8_t * bytes, size_t leng
  * Packet management
  */
 
-picoquic_packet_t* picoquic_create_packet(picoquic_quic_t * quic)
+static picoquic_packet_t** picoquic_packet_pool_head(picoquic_quic_t* quic, size_t bytes_max)
 {
-    picoquic_packet_t* packet = quic->p_first_packet;
+    return (bytes_max == PICOQUIC_SMALL_PACKET_SIZE) ? &quic->p_first_small_packet :
+        ((bytes_max == PICOQUIC_MAX_PACKET_SIZE) ? &quic->p_first_packet : &quic->p_first_jumbo_packet);
+}
+
+/* Create a packet of the smallest size class that can hold "length" bytes.
+ */
+picoquic_packet_t* picoquic_create_packet_ex(picoquic_quic_t * quic, size_t length)
+{
+    size_t bytes_max = PICOQUIC_SIZE_CLASS(length);
+    picoquic_packet_t** p_first = picoquic_packet_pool_head(quic, bytes_max);
+    picoquic_packet_t* packet = *p_first;
     
     if (packet == NULL) {
-        packet = (picoquic_packet_t*)malloc(sizeof(picoquic_packet_t));
+        packet = (picoquic_packet_t*)malloc(PICOQUIC_PACKET_ALLOC_SIZE(bytes_max));
         if (packet != NULL) {
             quic->nb_packets_allocated++;
             if (quic->nb_packets_allocated > quic->nb_packets_allocated_max) {
@@ -478,7 +934,7 @@ picoquic_packet_t* picoquic_create_packet(picoquic_quic_t * quic)
         }
     }
     else {
-        quic->p_first_packet = packet->packet_previous;
+        *p_first = packet->packet_previous;
         quic->nb_packets_in_pool--;
     }
 
@@ -486,28 +942,113 @@ picoquic_packet_t* picoquic_create_packet(picoquic_quic_t * quic)
         /* It might be sufficient to zero the metadata, but zeroing everything
          * appears safer, and does not confuse checkers like valgrind.
          */
-        memset(packet, 0, sizeof(picoquic_packet_t));
+        memset(packet, 0, PICOQUIC_PACKET_ALLOC_SIZE(bytes_max));
+        packet->bytes_max = bytes_max;
     }
 
     return packet;
 }
 
+picoquic_packet_t* picoquic_create_packet(picoquic_quic_t* quic)
+{
+    return picoquic_create_packet_ex(quic, PICOQUIC_MAX_PACKET_SIZE);
+}
+
 void picoquic_recycle_packet(picoquic_quic_t * quic, picoquic_packet_t* packet)
 {
     if (packet != NULL) {
-        if (quic->nb_packets_in_pool >= PICOQUIC_MAX_PACKETS_IN_POOL) {
+        if ((size_t)quic->nb_packets_in_pool >= quic->tuning.max_packets_in_pool &&
+            !picoquic_is_prewarmed(quic, packet)) {
             free(packet);
             quic->nb_packets_allocated--;
         }
         else {
+            size_t bytes_max = packet->bytes_max;
+            picoquic_packet_t** p_first = picoquic_packet_pool_head(quic, bytes_max);
+
             memset(packet, 0, offsetof(struct st_picoquic_packet_t, bytes));
-            packet->packet_previous = quic->p_first_packet;
-            quic->p_first_packet = packet;
+            packet->bytes_max = bytes_max;
+            packet->packet_previous = *p_first;
+            *p_first = packet;
             quic->nb_packets_in_pool++;
         }
     }
 }
 
+/* Recycle a packet that was queued in the connection, releasing the
+ * memory charged when it was queued for retransmit. */
+void picoquic_recycle_queued_packet(picoquic_cnx_t* cnx, picoquic_packet_t* packet)
+{
+    if (packet != NULL && packet->is_charged_to_cnx) {
+        picoquic_memory_discharge(cnx, picoquic_memory_retransmit, PICOQUIC_PACKET_ALLOC_SIZE(packet->bytes_max));
+    }
+    picoquic_recycle_packet(cnx->quic, packet);
+}
+
+/* Once a packet is sent and queued for retransmission, its content does not
+ * change. If it fits in a smaller size class, copy it to a packet of that
+ * class, so that ACK-only and control packets waiting for acknowledgement do
+ * not hold a full size buffer, and regular packets do not hold a jumbo
+ * buffer. If lost stream data is resent from the retained send queue, the
+ * retained stream data is first stripped from the packet, so that data
+ * packets only hold the metadata of their stream frames. This is not done if
+ * preemptive or redundant repeats are enabled, because these copy the frames
+ * of the queued packets. Returns the packet now in the queue.
+ */
+picoquic_packet_t* picoquic_compact_queued_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_t* packet)
+{
+    picoquic_packet_context_t* pkt_ctx = (packet->ptype == picoquic_packet_1rtt_protected && PICOQUIC_CNX_IS_MULTIPATH(cnx)) ?
+        &path_x->pkt_ctx : &cnx->pkt_ctx[packet->pc];
+
+    if (packet->is_queued_for_retransmit && !packet->is_queued_for_data_repeat &&
+        !packet->is_queued_for_spurious_detection &&
+        (packet->packet_previous != NULL || pkt_ctx->pending_first == packet) &&
+        (packet->packet_next != NULL || pkt_ctx->pending_last == packet)) {
+        if (cnx->is_stream_repeat_from_queue && !cnx->is_preemptive_repeat_enabled &&
+            (cnx->path_scheduler == NULL || cnx->path_scheduler->redundant_packet_max == 0) &&
+            packet->ptype == picoquic_packet_1rtt_protected &&
+            !packet->is_mtu_probe && !packet->is_ack_trap && !packet->is_multipath_probe) {
+            (void)picoquic_strip_retained_stream_data(cnx, packet);
+        }
+
+        if (packet->bytes_max > PICOQUIC_SIZE_CLASS(packet->length)) {
+            picoquic_packet_t* small_packet = picoquic_create_packet_ex(cnx->quic, packet->length);
+
+            if (small_packet != NULL) {
+                memcpy(small_packet, packet, PICOQUIC_PACKET_ALLOC_SIZE(packet->length));
+                small_packet->bytes_max = PICOQUIC_SIZE_CLASS(packet->length);
+
+                if (small_packet->packet_previous == NULL) {
+                    pkt_ctx->pending_first = small_packet;
+                }
+                else {
+                    small_packet->packet_previous->packet_next = small_packet;
+                }
+                if (small_packet->packet_next == NULL) {
+                    pkt_ctx->pending_last = small_packet;
+                }
+                else {
+                    small_packet->packet_next->packet_previous = small_packet;
+                }
+                if (pkt_ctx->preemptive_repeat_ptr == packet) {
+                    pkt_ctx->preemptive_repeat_ptr = small_packet;
+                }
+                if (picoquic_packet_index_find(&pkt_ctx->pending_index, packet->sequence_number) == packet) {
+                    pkt_ctx->pending_index.slots[packet->sequence_number & (pkt_ctx->pending_index.nb_slots - 1)] = small_packet;
+                }
+                if (packet->is_charged_to_cnx) {
+                    picoquic_memory_discharge(cnx, picoquic_memory_retransmit, PICOQUIC_PACKET_ALLOC_SIZE(packet->bytes_max));
+                    picoquic_memory_charge(cnx, picoquic_memory_retransmit, PICOQUIC_PACKET_ALLOC_SIZE(small_packet->bytes_max));
+                }
+                picoquic_recycle_packet(cnx->quic, packet);
+                packet = small_packet;
+            }
+        }
+    }
+
+    return packet;
+}
+
 void picoquic_update_payload_length(
     uint8_t* bytes, size_t pnum_index, size_t header_length, size_t packet_length)
 {
@@ -805,6 +1346,18 @@ size_t picoquic_get_checksum_length(picoquic_cnx_t* cnx, picoquic_epoch_enum epo
     return ret;
 }
 
+void picoquic_apply_header_mask(uint8_t* send_buffer, size_t pn_offset, uint8_t first_mask, const uint8_t* mask_bytes)
+{
+    /* Encode the first byte */
+    uint8_t pn_l = (send_buffer[0] & 3) + 1;
+    send_buffer[0] ^= (mask_bytes[0] & first_mask);
+
+    /* Packet encoding is 1 to 4 bytes */
+    for (uint8_t i = 0; i < pn_l; i++) {
+        send_buffer[pn_offset + i] ^= mask_bytes[i + 1];
+    }
+}
+
 void picoquic_protect_packet_header(uint8_t * send_buffer, size_t pn_offset, uint8_t first_mask, void* pn_enc)
 {
     /* The sample is located after the pn_offset */
@@ -814,17 +1367,9 @@ void picoquic_protect_packet_header(uint8_t * send_buffer, size_t pn_offset, uin
     {
         /* This is always true, as we use pn_length = 4 */
         uint8_t mask_bytes[5] = { 0, 0, 0, 0, 0 };
-        uint8_t pn_l;
 
         picoquic_pn_encrypt(pn_enc, send_buffer + sample_offset, mask_bytes, mask_bytes, 5);
-        /* Encode the first byte */
-        pn_l = (send_buffer[0] & 3) + 1;
-        send_buffer[0] ^= (mask_bytes[0] & first_mask);
-
-        /* Packet encoding is 1 to 4 bytes */
-        for (uint8_t i = 0; i < pn_l; i++) {
-            send_buffer[pn_offset+i] ^= mask_bytes[i+1];
-        }
+        picoquic_apply_header_mask(send_buffer, pn_offset, first_mask, mask_bytes);
     }
 }
 
@@ -846,6 +1391,7 @@ size_t picoquic_protect_packet(picoquic_cnx_t* cnx,
     size_t pn_sample_start;
     size_t pn_sample_end;
     uint8_t first_mask = 0x0F;
+    picoquic_protect_batch_item_t protect_item = { 0 };
 
     if (tuple == NULL) {
         tuple = path_x->first_tuple;
@@ -902,29 +1448,129 @@ size_t picoquic_protect_packet(picoquic_cnx_t* cnx,
         }
     }
 
-    /* Encrypt the packet */
-    if (cnx->is_multipath_enabled && ptype == picoquic_packet_1rtt_protected) {
-        send_length = picoquic_aead_encrypt_mp(send_buffer + /* header_length */ h_length,
-            bytes + header_length, length - header_length, path_x->unique_path_id,
-            sequence_number, send_buffer, /* header_length */ h_length, aead_context);
-    }
-    else {
-        send_length = picoquic_aead_encrypt_generic(send_buffer + /* header_length */ h_length,
-            bytes + header_length, length - header_length,
-            sequence_number, send_buffer, /* header_length */ h_length, aead_context);
+    /* Encrypt the packet and compute the header protection mask */
+    protect_item.packet = send_buffer;
+    protect_item.header_length = h_length;
+    protect_item.pn_offset = pn_offset;
+    protect_item.payload = bytes + header_length;
+    protect_item.payload_length = length - header_length;
+    protect_item.sequence_number = sequence_number;
+    protect_item.path_id = path_x->unique_path_id;
+    picoquic_aead_seal_batch(aead_context, pn_enc,
+        PICOQUIC_CNX_IS_MULTIPATH(cnx) && ptype == picoquic_packet_1rtt_protected, &protect_item, 1);
+    send_length = protect_item.packet_length;
+
+    /* if needed, log the segment before header protection is applied */
+    picoquic_log_outgoing_packet(cnx, path_x,
+        bytes, sequence_number, pn_length, length,
+        send_buffer, send_length, current_time);
+
+    /* Next, encrypt the PN -- The mask was computed from the sample located after the pn_offset */
+    picoquic_apply_header_mask(send_buffer, pn_offset, first_mask, protect_item.mask);
+
+    return send_length;
+}
+
+/*
+ * Index of the packets queued for retransmission or for detection of
+ * spurious retransmissions. When two queued packets map to the same slot,
+ * the ring is rebuilt from the queue with twice the size.
+ */
+
+static int picoquic_packet_index_rebuild(picoquic_packet_index_t* index, picoquic_packet_t* list_first, size_t nb_slots)
+{
+    int ret = 0;
+    picoquic_packet_t** slots = (picoquic_packet_t**)malloc(nb_slots * sizeof(picoquic_packet_t*));
+
+    if (slots == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_packet_t* p = list_first;
+
+        memset(slots, 0, nb_slots * sizeof(picoquic_packet_t*));
+        while (p != NULL) {
+            picoquic_packet_t** slot = &slots[p->sequence_number & (nb_slots - 1)];
+            if (*slot != NULL) {
+                ret = -1;
+                break;
+            }
+            *slot = p;
+            p = p->packet_next;
+        }
+        if (ret == 0) {
+            if (index->slots != NULL) {
+                free(index->slots);
+            }
+            index->slots = slots;
+            index->nb_slots = nb_slots;
+        }
+        else {
+            free(slots);
+        }
+    }
+    return ret;
+}
+
+/* Add a packet to the index, after it was linked in the list starting at list_first */
+static void picoquic_packet_index_insert(picoquic_packet_index_t* index, picoquic_packet_t* list_first, picoquic_packet_t* p)
+{
+    if (index->is_disabled && list_first == p && p->packet_next == NULL) {
+        /* The queue was empty, try the index again */
+        index->is_disabled = 0;
+    }
+    if (!index->is_disabled) {
+        picoquic_packet_t** slot = (index->slots == NULL) ? NULL : &index->slots[p->sequence_number & (index->nb_slots - 1)];
+
+        if (slot != NULL && *slot == NULL) {
+            *slot = p;
+        }
+        else {
+            size_t nb_slots = (index->slots == NULL) ? PICOQUIC_PACKET_INDEX_MIN_SLOTS : 2 * index->nb_slots;
+
+            while (nb_slots <= PICOQUIC_PACKET_INDEX_MAX_SLOTS &&
+                picoquic_packet_index_rebuild(index, list_first, nb_slots) != 0) {
+                nb_slots *= 2;
+            }
+            if (nb_slots > PICOQUIC_PACKET_INDEX_MAX_SLOTS) {
+                picoquic_packet_index_free(index);
+                index->is_disabled = 1;
+            }
+        }
+    }
+}
+
+static void picoquic_packet_index_remove(picoquic_packet_index_t* index, picoquic_packet_t* p)
+{
+    if (index->slots != NULL) {
+        picoquic_packet_t** slot = &index->slots[p->sequence_number & (index->nb_slots - 1)];
+        if (*slot == p) {
+            *slot = NULL;
+        }
     }
+}
 
-    send_length += /* header_length */ h_length;
-
-    /* if needed, log the segment before header protection is applied */
-    picoquic_log_outgoing_packet(cnx, path_x,
-        bytes, sequence_number, pn_length, length,
-        send_buffer, send_length, current_time);
+/* Find a queued packet by sequence number. If the index is disabled,
+ * returns NULL, and the caller shall search the queue. */
+picoquic_packet_t* picoquic_packet_index_find(picoquic_packet_index_t* index, uint64_t sequence_number)
+{
+    picoquic_packet_t* p = NULL;
 
-    /* Next, encrypt the PN -- The sample is located after the pn_offset */
-    picoquic_protect_packet_header(send_buffer, pn_offset, first_mask, pn_enc);
+    if (index->slots != NULL) {
+        p = index->slots[sequence_number & (index->nb_slots - 1)];
+        if (p != NULL && p->sequence_number != sequence_number) {
+            p = NULL;
+        }
+    }
+    return p;
+}
 
-    return send_length;
+void picoquic_packet_index_free(picoquic_packet_index_t* index)
+{
+    if (index->slots != NULL) {
+        free(index->slots);
+    }
+    memset(index, 0, sizeof(picoquic_packet_index_t));
 }
 
 /*
@@ -936,7 +1582,7 @@ void picoquic_queue_for_retransmit(picoquic_cnx_t* cnx, picoquic_path_t * path_x
 {
     picoquic_packet_context_t* pkt_ctx = NULL;
     
-    if (packet->ptype == picoquic_packet_1rtt_protected && cnx->is_multipath_enabled) {
+    if (packet->ptype == picoquic_packet_1rtt_protected && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         pkt_ctx = &path_x->pkt_ctx;
     }
     else {
@@ -954,6 +1600,11 @@ void picoquic_queue_for_retransmit(picoquic_cnx_t* cnx, picoquic_path_t * path_x
     }
     pkt_ctx->pending_last = packet;
     packet->is_queued_for_retransmit = 1;
+    picoquic_packet_index_insert(&pkt_ctx->pending_index, pkt_ctx->pending_first, packet);
+    if (!packet->is_charged_to_cnx) {
+        picoquic_memory_charge(cnx, picoquic_memory_retransmit, PICOQUIC_PACKET_ALLOC_SIZE(packet->bytes_max));
+        packet->is_charged_to_cnx = 1;
+    }
 
     if (!packet->is_ack_trap) {
         /* Account for bytes in transit, for congestion control */
@@ -962,13 +1613,22 @@ void picoquic_queue_for_retransmit(picoquic_cnx_t* cnx, picoquic_path_t * path_x
         /* Update the pacing data */
         picoquic_update_pacing_after_send(path_x, length, current_time);
     }
+
+    if (cnx->path_scheduler != NULL && cnx->path_scheduler->redundant_packet_max > 0 &&
+        PICOQUIC_CNX_IS_MULTIPATH(cnx) && cnx->nb_paths > 1 && packet->ptype == picoquic_packet_1rtt_protected &&
+        !packet->is_preemptive_repeat && !packet->is_ack_trap && !packet->is_mtu_probe &&
+        !packet->is_multipath_probe && packet->length <= cnx->path_scheduler->redundant_packet_max) {
+        /* Ask the path scheduler to repeat this packet on another path */
+        cnx->is_redundant_repeat_pending = 1;
+        cnx->redundant_source_path_id = path_x->unique_path_id;
+    }
 }
 
 picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx, 
     picoquic_packet_context_t * pkt_ctx, picoquic_packet_t* p, int should_free,
     int add_to_data_repeat_queue)
 {
-    size_t dequeued_length = p->length + p->checksum_overhead;
+    size_t dequeued_length = PICOQUIC_PACKET_SENT_LENGTH(p) + p->checksum_overhead;
 
     if (p->is_queued_for_retransmit) {
         /* Remove from list */
@@ -986,6 +1646,7 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx,
             p->packet_previous->packet_next = p->packet_next;
         }
         p->is_queued_for_retransmit = 0;
+        picoquic_packet_index_remove(&pkt_ctx->pending_index, p);
     }
 
     /* Account for bytes in transit, for congestion control */
@@ -1010,7 +1671,7 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx,
             picoquic_queue_data_repeat_packet(cnx, p);
         }
         else {
-            picoquic_recycle_packet(cnx->quic, p);
+            picoquic_recycle_queued_packet(cnx, p);
             p = NULL;
         }
     } 
@@ -1029,6 +1690,7 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx,
         }
         pkt_ctx->retransmitted_queue_size += 1;
         p->is_queued_for_spurious_detection = 1;
+        picoquic_packet_index_insert(&pkt_ctx->retransmitted_index, pkt_ctx->retransmitted_newest, p);
 
         if (add_to_data_repeat_queue) {
             picoquic_queue_data_repeat_packet(cnx, p);
@@ -1041,6 +1703,7 @@ picoquic_packet_t* picoquic_dequeue_retransmit_packet(picoquic_cnx_t* cnx,
 void picoquic_dequeue_retransmitted_packet(picoquic_cnx_t* cnx, picoquic_packet_context_t* pkt_ctx, picoquic_packet_t* p)
 {
     pkt_ctx->retransmitted_queue_size -= 1;
+    picoquic_packet_index_remove(&pkt_ctx->retransmitted_index, p);
     if (p->packet_previous == NULL) {
         pkt_ctx->retransmitted_newest = p->packet_next;
     }
@@ -1060,7 +1723,7 @@ void picoquic_dequeue_retransmitted_packet(picoquic_cnx_t* cnx, picoquic_packet_
     * when removed from both queues */
     p->is_queued_for_spurious_detection = 0;
     if (!p->is_queued_for_data_repeat) {
-        picoquic_recycle_packet(cnx->quic, p);
+        picoquic_recycle_queued_packet(cnx, p);
     }
 }
 
@@ -1080,7 +1743,7 @@ void picoquic_insert_hole_in_send_sequence_if_needed(picoquic_cnx_t* cnx, picoqu
         if (pkt_ctx->next_sequence_hole != 0 &&
             !pkt_ctx->pending_last->is_ack_trap) {
             /* Insert a hole in sequence */
-            picoquic_packet_t* packet = picoquic_create_packet(cnx->quic);
+            picoquic_packet_t* packet = picoquic_create_packet_ex(cnx->quic, 0);
 
             if (packet != NULL) {
                 packet->is_ack_trap = 1;
@@ -1119,7 +1782,7 @@ void picoquic_finalize_and_protect_packet(picoquic_cnx_t *cnx,
     if (ret == 0 && length > 0) {
         packet->length = length;
         
-        if (packet->ptype == picoquic_packet_1rtt_protected && cnx->is_multipath_enabled) {
+        if (packet->ptype == picoquic_packet_1rtt_protected && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
             packet->sequence_number = path_x->pkt_ctx.send_sequence++;
         } else {
             packet->sequence_number = cnx->pkt_ctx[packet->pc].send_sequence++;
@@ -1181,6 +1844,10 @@ void picoquic_finalize_and_protect_packet(picoquic_cnx_t *cnx,
 
         if (length > 0) {
             packet->checksum_overhead = checksum_overhead;
+            if (cnx->is_fec_negotiated && cnx->fec_block_size > 0 && packet->ptype == picoquic_packet_1rtt_protected) {
+                picoquic_fec_add_source(cnx, path_x, packet, header_length, length - header_length - checksum_overhead,
+                    checksum_overhead, current_time);
+            }
             picoquic_queue_for_retransmit(cnx, path_x, packet, length, current_time);
             path_x->last_sent_time = current_time;
             path_x->bytes_sent += length;
@@ -1238,7 +1905,7 @@ int picoquic_is_cnx_backlog_empty(picoquic_cnx_t* cnx)
             picoquic_is_pkt_ctx_backlog_empty(&cnx->pkt_ctx[picoquic_packet_context_handshake]);
     }
 
-    if (cnx->is_multipath_enabled) {
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         for (int i=0; backlog_empty && i < cnx->nb_paths; i++) {
             backlog_empty &= picoquic_is_pkt_ctx_backlog_empty(&cnx->path[i]->pkt_ctx);
         }
@@ -1253,7 +1920,9 @@ int picoquic_is_cnx_backlog_empty(picoquic_cnx_t* cnx)
 /* Management of preemptive repeats.
  * This function only perform preemptive repeat for packets that contain
  * at least on frame that triggers premptive repeat, such as a stream
- * belonging to a stream for which FIN was sent. If a packet is
+ * belonging to a stream for which FIN was sent. The set of acceptable
+ * triggers is passed in "preemptive_mask", see picoquic_preemptive_repeat_mask.
+ * If a packet is
  * selected for preemptive repeat, then the function attempts to repeat
  * all frames that are not "pure ack". If all such frames are repeated,
  * the old packet can be marked as "was_preemptively_repeated", so that
@@ -1267,7 +1936,9 @@ static int picoquic_preemptive_retransmit_packet(picoquic_packet_t* old_p,
     uint8_t* new_bytes,
     size_t send_buffer_max_minus_checksum,
     size_t* length,
-    int * has_data)
+    int * has_data,
+    int preemptive_mask,
+    int is_forced)
 {
     /* check if this is an ACK only packet */
     int ret = 0;
@@ -1299,7 +1970,12 @@ static int picoquic_preemptive_retransmit_packet(picoquic_packet_t* old_p,
             }
 
             /* Prepare retransmission if needed */
-            if (ret == 0 && !frame_is_pure_ack) {
+            if (ret == 0 && !frame_is_pure_ack &&
+                picoquic_is_stream_metadata_frame(&old_p->bytes[byte_index], frame_length)) {
+                /* The stream data was stripped after sending, it cannot be copied */
+                is_repeated = 0;
+            }
+            else if (ret == 0 && !frame_is_pure_ack) {
                 if (PICOQUIC_IN_RANGE(old_p->bytes[byte_index], picoquic_frame_type_stream_range_min, picoquic_frame_type_stream_range_max) &&
                     picoquic_is_stream_frame_unlimited(&old_p->bytes[byte_index])) {
                     /* If length is not present, check whether needed */
@@ -1326,7 +2002,7 @@ static int picoquic_preemptive_retransmit_packet(picoquic_packet_t* old_p,
     }
 
     if (*has_data) {
-        if (!is_preemptive_needed) {
+        if ((is_preemptive_needed & preemptive_mask) == 0 && !is_forced) {
             /* If the packet does not contain any frame requiring preemptive repeat, do not repeat it. */
             *length = initial_length;
             *has_data = 0;
@@ -1339,9 +2015,60 @@ static int picoquic_preemptive_retransmit_packet(picoquic_packet_t* old_p,
     return ret;
 }
 
+/* Estimate the loss probability of the path and the budget of preemptive
+ * repeats once per RTT. The loss probability is a moving average of the
+ * fraction of bytes lost per epoch. The budget is a fraction of the
+ * congestion window, 1/8 plus twice the loss probability, capped at 1/2,
+ * and at least a few packets so that short transactions are covered.
+ */
+void picoquic_update_preemptive_repeat_budget(picoquic_path_t* path_x, uint64_t current_time)
+{
+    uint64_t epoch_duration = (path_x->smoothed_rtt > 0) ? path_x->smoothed_rtt : PICOQUIC_INITIAL_RTT;
+
+    if (path_x->loss_epoch_start == 0 || path_x->loss_epoch_start + epoch_duration <= current_time) {
+        uint64_t sent = path_x->bytes_sent - path_x->loss_epoch_bytes_sent;
+        uint64_t lost = path_x->total_bytes_lost - path_x->loss_epoch_bytes_lost;
+        uint64_t budget_fraction;
+        uint64_t budget_min = PICOQUIC_PREEMPTIVE_BUDGET_MIN_PACKETS * path_x->send_mtu;
+
+        if (sent > 0) {
+            uint64_t sample = (lost >= sent) ? PICOQUIC_LOSS_PROBABILITY_ONE : (lost * PICOQUIC_LOSS_PROBABILITY_ONE) / sent;
+            path_x->loss_probability = (7 * path_x->loss_probability + sample) / 8;
+        }
+        path_x->loss_epoch_start = current_time;
+        path_x->loss_epoch_bytes_sent = path_x->bytes_sent;
+        path_x->loss_epoch_bytes_lost = path_x->total_bytes_lost;
+
+        budget_fraction = PICOQUIC_LOSS_PROBABILITY_ONE / 8 + 2 * path_x->loss_probability;
+        if (budget_fraction > PICOQUIC_LOSS_PROBABILITY_ONE / 2) {
+            budget_fraction = PICOQUIC_LOSS_PROBABILITY_ONE / 2;
+        }
+        path_x->preemptive_repeat_budget = (path_x->cwin * budget_fraction) / PICOQUIC_LOSS_PROBABILITY_ONE;
+        if (path_x->preemptive_repeat_budget < budget_min) {
+            path_x->preemptive_repeat_budget = budget_min;
+        }
+    }
+}
+
+/* Frames closing a stream or the handshake are always worth repeating, since
+ * their loss would stall the transaction until a timer fires. The last frame
+ * of a message that is not closing the stream is only repeated if the path
+ * is lossy.
+ */
+int picoquic_preemptive_repeat_mask(picoquic_path_t* path_x)
+{
+    int preemptive_mask = PICOQUIC_PREEMPTIVE_STREAM_FIN | PICOQUIC_PREEMPTIVE_HANDSHAKE_TAIL;
+
+    if (path_x->loss_probability >= PICOQUIC_PREEMPTIVE_LOSSY_THRESHOLD) {
+        preemptive_mask |= PICOQUIC_PREEMPTIVE_MESSAGE_TAIL;
+    }
+    return preemptive_mask;
+}
+
 int picoquic_preemptive_retransmit_in_context(
     picoquic_cnx_t* cnx,
     picoquic_packet_context_t* pkt_ctx,
+    int preemptive_mask,
     uint64_t rtt,
     uint64_t current_time,
     uint64_t* next_wake_time,
@@ -1395,7 +2122,7 @@ int picoquic_preemptive_retransmit_in_context(
                 break;
             }
             ret = picoquic_preemptive_retransmit_packet(pkt_ctx->preemptive_repeat_ptr, cnx,
-                new_bytes, send_buffer_max_minus_checksum, length, has_data);
+                new_bytes, send_buffer_max_minus_checksum, length, has_data, preemptive_mask, 0);
             if (ret != 0) {
                 break;
             }
@@ -1436,13 +2163,22 @@ int picoquic_preemptive_retransmit_as_needed(
     int has_data = 0;
     picoquic_packet_context_t* pkt_ctx;
     uint64_t rtt = path_x->smoothed_rtt;
+    size_t initial_length = *length;
+    int preemptive_mask;
+
+    picoquic_update_preemptive_repeat_budget(path_x, current_time);
+    if (path_x->preemptive_repeat_budget < path_x->send_mtu) {
+        /* The repeats in this epoch already used the budget */
+        return 0;
+    }
+    preemptive_mask = picoquic_preemptive_repeat_mask(path_x);
 
     if (pc == picoquic_packet_context_application &&
-        cnx->is_multipath_enabled) {
+        PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         for (int i = 0; i < cnx->nb_paths; i++) {
             pkt_ctx = &cnx->path[i]->pkt_ctx;
             ret = picoquic_preemptive_retransmit_in_context(
-                cnx, pkt_ctx, rtt, current_time, next_wake_time,
+                cnx, pkt_ctx, preemptive_mask, rtt, current_time, next_wake_time,
                 new_bytes, send_buffer_max_minus_checksum, length, &has_data, more_data, is_pure_ack == NULL);
             if (ret != 0 || has_data != 0) {
                 break;
@@ -1452,7 +2188,7 @@ int picoquic_preemptive_retransmit_as_needed(
     else {
         pkt_ctx = &cnx->pkt_ctx[pc];
         ret = picoquic_preemptive_retransmit_in_context(
-            cnx, pkt_ctx, rtt, current_time, next_wake_time,
+            cnx, pkt_ctx, preemptive_mask, rtt, current_time, next_wake_time,
             new_bytes, send_buffer_max_minus_checksum, length, &has_data, more_data, is_pure_ack == NULL);
     }
     
@@ -1460,6 +2196,56 @@ int picoquic_preemptive_retransmit_as_needed(
         *is_pure_ack &= !has_data;
     }
 
+    if (has_data) {
+        uint64_t repeated = *length - initial_length;
+
+        path_x->preemptive_repeat_budget = (repeated >= path_x->preemptive_repeat_budget) ? 0 :
+            path_x->preemptive_repeat_budget - repeated;
+        cnx->nb_preemptive_repeat_bytes += repeated;
+    }
+
+    return ret;
+}
+
+/* Redundant scheduling: small packets sent recently on another path
+ * are repeated on this path, so they are delivered by whichever path is
+ * the fastest at the time. Packets older than half the RTT of the path
+ * on which they were sent are not repeated.
+ */
+static int picoquic_redundant_repeat_as_needed(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    uint64_t current_time, uint8_t* new_bytes, size_t send_buffer_max_minus_checksum, size_t* length)
+{
+    int ret = 0;
+    int has_data = 0;
+    size_t redundant_max = cnx->path_scheduler->redundant_packet_max;
+
+    for (int i = 0; ret == 0 && !has_data && i < cnx->nb_paths; i++) {
+        picoquic_path_t* old_path = cnx->path[i];
+        picoquic_packet_t* old_p = old_path->pkt_ctx.pending_last;
+
+        if (old_path == path_x) {
+            continue;
+        }
+        while (old_p != NULL && old_p->send_time + old_path->smoothed_rtt / 2 >= current_time) {
+            if (!old_p->is_preemptive_repeat && !old_p->was_preemptively_repeated &&
+                old_p->ptype == picoquic_packet_1rtt_protected && PICOQUIC_PACKET_SENT_LENGTH(old_p) <= redundant_max) {
+                ret = picoquic_preemptive_retransmit_packet(old_p, cnx, new_bytes,
+                    send_buffer_max_minus_checksum, length, &has_data, 0, 1);
+                if (ret != 0 || has_data) {
+                    break;
+                }
+            }
+            old_p = old_p->packet_previous;
+        }
+    }
+
+    if (has_data) {
+        cnx->nb_redundant_repeat++;
+    }
+    else {
+        cnx->is_redundant_repeat_pending = 0;
+    }
+
     return ret;
 }
 
@@ -1476,8 +2262,8 @@ static size_t picoquic_next_mtu_probe_length(picoquic_cnx_t* cnx, picoquic_path_
                 cnx->quic->mtu_max - PICOQUIC_MTU_OVERHEAD((struct sockaddr*)&path_x->first_tuple->peer_addr)) {
                 probe_length = cnx->quic->mtu_max - PICOQUIC_MTU_OVERHEAD((struct sockaddr*)&path_x->first_tuple->peer_addr);
             }
-            else if (probe_length > PICOQUIC_MAX_PACKET_SIZE) {
-                probe_length = PICOQUIC_MAX_PACKET_SIZE;
+            else if (probe_length > picoquic_get_max_packet_size(cnx->quic)) {
+                probe_length = picoquic_get_max_packet_size(cnx->quic);
             }
             if (probe_length < path_x->send_mtu) {
                 probe_length = path_x->send_mtu;
@@ -1489,17 +2275,30 @@ static size_t picoquic_next_mtu_probe_length(picoquic_cnx_t* cnx, picoquic_path_
         else {
             probe_length = PICOQUIC_PRACTICAL_MAX_MTU;
         }
+        if (path_x->send_mtu_cached > path_x->send_mtu && path_x->send_mtu_cached < probe_length) {
+            /* Previous connections to that peer found a smaller MTU */
+            probe_length = path_x->send_mtu_cached;
+        }
     }
     else {
-        if (path_x->send_mtu_max_tried > 1500) {
+        /* A probe failed. Binary search between the validated MTU and the
+         * failed probe, until the interval becomes narrower than the search
+         * step. The common Ethernet and tunnel MTU are tried first. */
+        size_t probe_step = (path_x->send_mtu_max_tried > PICOQUIC_MAX_PACKET_SIZE) ?
+            PICOQUIC_MTU_JUMBO_PROBE_STEP : PICOQUIC_MTU_PROBE_STEP;
+
+        if (path_x->send_mtu < 1500 && path_x->send_mtu_max_tried > 1500) {
             probe_length = 1500;
         }
-        else if (path_x->send_mtu_max_tried > 1400) {
+        else if (path_x->send_mtu < 1400 && path_x->send_mtu_max_tried > 1400) {
             probe_length = 1400;
         }
-        else {
+        else if (path_x->send_mtu + probe_step < path_x->send_mtu_max_tried) {
             probe_length = (path_x->send_mtu + path_x->send_mtu_max_tried) / 2;
         }
+        else {
+            probe_length = path_x->send_mtu;
+        }
     }
 
     return probe_length;
@@ -1514,31 +2313,31 @@ picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t*
         cnx->cnx_state == picoquic_state_client_ready_start || 
         cnx->cnx_state == picoquic_state_server_false_start)
         && path_x->mtu_probe_sent == 0 && cnx->pmtud_policy != picoquic_pmtud_blocked) {
-        if (path_x->send_mtu_max_tried == 0 || path_x->send_mtu_max_tried > 1400) {
-            /* MTU discovery is required if the chances of success are large enough
-             * and there are enough packets to send to amortize the discovery cost.
-             * Of course we don't know at this stage how much data will be sent 
-             * on the connection; we take the amount of data queued as a proxy
-             * for that. */
-            uint64_t next_probe = picoquic_next_mtu_probe_length(cnx, path_x);
-            if (next_probe > path_x->send_mtu) {
-                if (cnx->pmtud_policy == picoquic_pmtud_required) {
+        /* MTU discovery is required if the chances of success are large enough
+         * and there are enough packets to send to amortize the discovery cost.
+         * Of course we don't know at this stage how much data will be sent 
+         * on the connection; we take the amount of data queued as a proxy
+         * for that. The value found by previous connections to the peer is
+         * probed without waiting. */
+        uint64_t next_probe = picoquic_next_mtu_probe_length(cnx, path_x);
+        if (next_probe > path_x->send_mtu) {
+            if (cnx->pmtud_policy == picoquic_pmtud_required ||
+                (path_x->send_mtu_max_tried == 0 && next_probe == path_x->send_mtu_cached)) {
+                ret = picoquic_pmtu_discovery_required;
+            }
+            else {
+                uint64_t packets_to_send_before = cnx->nb_bytes_queued / path_x->send_mtu;
+                uint64_t packets_to_send_after = cnx->nb_bytes_queued / next_probe;
+                uint64_t delta = (packets_to_send_before - packets_to_send_after) * 60;
+                if (delta > next_probe) {
                     ret = picoquic_pmtu_discovery_required;
                 }
                 else {
-                    uint64_t packets_to_send_before = cnx->nb_bytes_queued / path_x->send_mtu;
-                    uint64_t packets_to_send_after = cnx->nb_bytes_queued / next_probe;
-                    uint64_t delta = (packets_to_send_before - packets_to_send_after) * 60;
-                    if (delta > next_probe) {
-                        ret = picoquic_pmtu_discovery_required;
+                    if (cnx->pmtud_policy == picoquic_pmtud_basic) {
+                        ret = picoquic_pmtu_discovery_optional;
                     }
                     else {
-                        if (cnx->pmtud_policy == picoquic_pmtud_basic) {
-                            ret = picoquic_pmtu_discovery_optional;
-                        }
-                        else {
-                            ret = picoquic_pmtu_discovery_not_needed;
-                        }
+                        ret = picoquic_pmtu_discovery_not_needed;
                     }
                 }
             }
@@ -1548,6 +2347,22 @@ picoquic_pmtu_discovery_status_enum picoquic_is_mtu_probe_needed(picoquic_cnx_t*
     return ret;
 }
 
+/* Size of the buffer needed to prepare the next packet on a path. Jumbo
+ * buffers are only used if the path MTU or the next MTU probe exceed
+ * PICOQUIC_MAX_PACKET_SIZE. */
+static size_t picoquic_path_packet_size(picoquic_cnx_t* cnx, picoquic_path_t* path_x)
+{
+    size_t packet_size = PICOQUIC_MAX_PACKET_SIZE;
+
+    if (cnx->quic->mtu_max > PICOQUIC_MAX_PACKET_SIZE &&
+        (path_x->send_mtu > PICOQUIC_MAX_PACKET_SIZE ||
+        (path_x->mtu_probe_sent == 0 && picoquic_next_mtu_probe_length(cnx, path_x) > PICOQUIC_MAX_PACKET_SIZE))) {
+        packet_size = PICOQUIC_MAX_JUMBO_PACKET_SIZE;
+    }
+
+    return packet_size;
+}
+
 /* Prepare an MTU probe packet */
 size_t picoquic_prepare_mtu_probe(picoquic_cnx_t* cnx,
     picoquic_path_t * path_x,
@@ -1768,14 +2583,15 @@ void picoquic_implicit_handshake_ack(picoquic_cnx_t* cnx, picoquic_packet_contex
         if (old_path != NULL && cnx->congestion_alg != NULL && p->send_time < cnx->start_time + PICOQUIC_INITIAL_RTT) {
             picoquic_per_ack_state_t ack_state = { 0 };
             ack_state.rtt_measurement = old_path->rtt_sample;
-            ack_state.nb_bytes_acknowledged = p->length;
-            old_path->delivered += p->length;
+            ack_state.nb_bytes_acknowledged = PICOQUIC_PACKET_SENT_LENGTH(p);
+            old_path->delivered += PICOQUIC_PACKET_SENT_LENGTH(p);
             ack_state.nb_bytes_delivered_since_packet_sent = old_path->delivered - p->delivered_prior;
             ack_state.is_app_limited = 1;
 
             cnx->congestion_alg->alg_notify(cnx, old_path,
                 picoquic_congestion_notification_acknowledgement,
                 &ack_state, current_time);
+            PICOQUIC_PROBE_CC_NOTIFY(cnx, old_path, picoquic_congestion_notification_acknowledgement);
         }
         /* Update the number of bytes in transit and remove old packet from queue */
         /* The packet will not be placed in the "retransmitted" queue */
@@ -1792,7 +2608,7 @@ int picoquic_prepare_server_address_migration(picoquic_cnx_t* cnx)
     uint64_t transport_error = 0;
 
     if (cnx->remote_parameters.prefered_address.is_defined) {
-        uint64_t unique_path_id = (cnx->is_multipath_enabled) ? 1 : 0;
+        uint64_t unique_path_id = (PICOQUIC_CNX_IS_MULTIPATH(cnx)) ? 1 : 0;
         int ipv4_received = cnx->remote_parameters.prefered_address.ipv4Port != 0;
         int ipv6_received = cnx->remote_parameters.prefered_address.ipv6Port != 0;
 
@@ -2370,7 +3186,7 @@ int picoquic_prepare_packet_closing(picoquic_cnx_t* cnx, picoquic_path_t * path_
     /* At this stage, we don't try to retransmit any old packet, whether in
      * the current context or in previous contexts. */
 
-    if (packet_type == picoquic_packet_1rtt_protected && cnx->is_multipath_enabled) {
+    if (packet_type == picoquic_packet_1rtt_protected && PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         pkt_ctx = &path_x->pkt_ctx;
     }
     else {
@@ -2546,7 +3362,7 @@ uint8_t * picoquic_format_new_local_id_as_needed(picoquic_cnx_t* cnx, uint8_t* b
 {
     int no_space_left = 0;
     picoquic_local_cnxid_list_t* local_cnxid_list = cnx->first_local_cnxid_list;
-    if (cnx->is_multipath_enabled) {
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         /* If the number of local list is lower than the max number of paths, 
         * update that number and queue a MAX PATH ID frame.
          */
@@ -2578,7 +3394,7 @@ uint8_t * picoquic_format_new_local_id_as_needed(picoquic_cnx_t* cnx, uint8_t* b
         /* Push new CID if needed */
         while (
             local_cnxid_list->nb_local_cnxid < ((int)(cnx->remote_parameters.active_connection_id_limit) + local_cnxid_list->nb_local_cnxid_expired) &&
-            local_cnxid_list->nb_local_cnxid <= (PICOQUIC_NB_PATH_TARGET + local_cnxid_list->nb_local_cnxid_expired)) {
+            local_cnxid_list->nb_local_cnxid <= (picoquic_get_max_simultaneous_paths(cnx->quic) + local_cnxid_list->nb_local_cnxid_expired)) {
             uint8_t* bytes0 = bytes;
             picoquic_local_cnxid_t* l_cid = picoquic_create_local_cnxid(cnx, local_cnxid_list->unique_path_id, NULL, current_time);
 
@@ -2633,7 +3449,7 @@ void picoquic_client_almost_ready_transition(picoquic_cnx_t* cnx)
 {
     cnx->cnx_state = picoquic_state_client_almost_ready;
     /* If client, make sure that 0-RTT packets are in correct context */
-    if (cnx->is_multipath_enabled) {
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
         picoquic_packet_context_t* o_pkt_ctx = &cnx->pkt_ctx[0];
         picoquic_packet_context_t* n_pkt_ctx = &cnx->path[0]->pkt_ctx;
 
@@ -2648,6 +3464,7 @@ void picoquic_ready_state_transition(picoquic_cnx_t* cnx, uint64_t current_time)
      * The handshake is complete, all the handshake packets are implicitly acknowledged */
     cnx->cnx_state = picoquic_state_ready;
     cnx->is_handshake_finished = 1;
+    picoquic_metrics_handshake_done(cnx, current_time);
     picoquic_implicit_handshake_ack(cnx, picoquic_packet_context_initial, current_time);
     picoquic_implicit_handshake_ack(cnx, picoquic_packet_context_handshake, current_time);
 
@@ -2731,6 +3548,11 @@ static uint8_t* picoquic_prepare_datagram_ready(picoquic_cnx_t* cnx, picoquic_pa
         bytes_next = picoquic_format_first_datagram_frame(cnx, bytes_next, bytes_max, more_data, is_pure_ack);
         *more_data |= (cnx->first_datagram != NULL);
     }
+    else if (cnx->datagram_ring != NULL && cnx->datagram_ring->nb_queued > 0) {
+        bytes_next = picoquic_format_ring_datagram_frames(cnx, bytes_next, bytes_max, more_data, is_pure_ack,
+            picoquic_get_quic_time(cnx->quic));
+        *more_data |= (cnx->datagram_ring->nb_queued > 0);
+    }
     else {
         while (cnx->is_datagram_ready || path_x->is_datagram_ready) {
             uint8_t* dg_start = bytes_next;
@@ -2806,10 +3628,12 @@ static uint8_t* picoquic_prepare_stream_and_datagrams(picoquic_cnx_t* cnx, picoq
         /* Find the highest priority level for which there is something to send, then
         * format the frames to send at that level. Repeat in a loop until the
         * packet is full or there is nothing more to send. */
-        uint64_t datagram_present = cnx->first_datagram != NULL || cnx->is_datagram_ready || path_x->is_datagram_ready;
+        uint64_t datagram_present = cnx->first_datagram != NULL || cnx->is_datagram_ready || path_x->is_datagram_ready ||
+            (cnx->datagram_ring != NULL && cnx->datagram_ring->nb_queued > 0);
         picoquic_stream_head_t* first_stream = picoquic_find_ready_stream_path(cnx,
-            (cnx->is_multipath_enabled) ? path_x : NULL);
+            (PICOQUIC_CNX_IS_MULTIPATH(cnx)) ? path_x : NULL);
         picoquic_packet_t* first_repeat = picoquic_first_data_repeat_packet(cnx);
+        picoquic_stream_head_t* first_repeat_stream = picoquic_first_repeat_stream(cnx);
         uint64_t current_priority = UINT64_MAX;
         uint64_t stream_priority = UINT64_MAX;
 #if 1
@@ -2831,6 +3655,9 @@ static uint8_t* picoquic_prepare_stream_and_datagrams(picoquic_cnx_t* cnx, picoq
         if (first_repeat != NULL && first_repeat->data_repeat_priority < stream_priority) {
             stream_priority = first_repeat->data_repeat_priority;
         }
+        if (first_repeat_stream != NULL && first_repeat_stream->stream_priority < stream_priority) {
+            stream_priority = first_repeat_stream->stream_priority;
+        }
         if (stream_priority < current_priority) {
             current_priority = stream_priority;
         }
@@ -2867,6 +3694,22 @@ static uint8_t* picoquic_prepare_stream_and_datagrams(picoquic_cnx_t* cnx, picoq
             }
         }
 
+        if (first_repeat_stream != NULL && first_repeat_stream->stream_priority == current_priority) {
+            uint8_t* bytes_first = bytes_next;
+            if (bytes_next + 8 < bytes_max) {
+                bytes_next = picoquic_copy_stream_repeats_for_retransmit(cnx, bytes_next, bytes_max,
+                    current_priority, &more_data_this_round, is_pure_ack);
+                if (bytes_next > bytes_first) {
+                    cnx->datagram_conflicts_count = 0;
+                    something_sent = 1;
+                }
+            }
+            else {
+                more_data_this_round |= 1;
+                conflict_found = 1;
+            }
+        }
+
         if (first_stream != NULL && first_stream->stream_priority == current_priority) {
             /* Encode the stream frame, or frames */
             uint8_t* bytes_first = bytes_next;
@@ -2905,7 +3748,8 @@ static uint8_t* picoquic_prepare_stream_and_datagrams(picoquic_cnx_t* cnx, picoq
 #endif
 
         if (is_first_round) {
-            *no_data_to_send = ((first_stream == NULL && first_repeat == NULL) || stream_tried_and_failed) &&
+            *no_data_to_send = ((first_stream == NULL && first_repeat == NULL && first_repeat_stream == NULL) ||
+                stream_tried_and_failed) &&
                 (!datagram_present || datagram_tried_and_failed);
         }
         is_first_round = 0;
@@ -3003,7 +3847,7 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
 
     if (length == 0) {
         picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[pc];
-        if (cnx->is_multipath_enabled) {
+        if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
             pkt_ctx = &path_x->pkt_ctx;
         }
 
@@ -3064,7 +3908,8 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                 }
 
                 length = bytes_next - bytes;
-                if (path_x->cwin < path_x->bytes_in_transit) {
+                if (path_x->cwin < path_x->bytes_in_transit ||
+                    (path_x->cc_group != NULL && picoquic_cc_manager_is_blocked(path_x, current_time, next_wake_time))) {
                     picoquic_per_ack_state_t ack_state = { 0 };
                     cnx->cwin_blocked = 1;
                     path_x->last_cwin_blocked_time = current_time;
@@ -3072,6 +3917,7 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                         cnx->congestion_alg->alg_notify(cnx, path_x,
                             picoquic_congestion_notification_cwin_blocked,
                             &ack_state, current_time);
+                        PICOQUIC_PROBE_CC_NOTIFY(cnx, path_x, picoquic_congestion_notification_cwin_blocked);
                     }
                 }
                 else {
@@ -3104,7 +3950,7 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                             bytes_next = picoquic_format_misc_frames_in_context(cnx, bytes_next, bytes_max,
                                 &more_data, &is_pure_ack, pc);
 
-                            if (cnx->is_address_discovery_provider) {
+                            if (PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_PROVIDER(cnx)) {
                                 /* If a new address was learned, prepare an observed address frame */
                                 /* TODO: tie this code to path challenge/response */
                                 bytes_next = picoquic_prepare_observed_address_frame(bytes_next, bytes_max,
@@ -3119,6 +3965,9 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                             if (cnx->is_ack_frequency_updated && cnx->is_ack_frequency_negotiated) {
                                 bytes_next = picoquic_format_ack_frequency_frame(cnx, bytes_next, bytes_max, &more_data);
                             }
+                            if (cnx->is_immediate_ack_pending && cnx->is_ack_frequency_negotiated) {
+                                bytes_next = picoquic_format_immediate_ack_if_pending(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack);
+                            }
                             if (ret == 0) {
                                 bytes_next = picoquic_prepare_stream_and_datagrams(cnx, path_x, bytes_next, bytes_max,
                                     UINT64_MAX, current_time,
@@ -3127,7 +3976,7 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                             /* TODO: replace this by posting of frame when CWIN estimated */
                             /* Send bdp frames if there are no stream frames to send
                              * and if client wishes to receive bdp frames */
-                            if (!cnx->client_mode && cnx->send_receive_bdp_frame) {
+                            if (!cnx->client_mode && PICOQUIC_CNX_IS_BDP_FRAME_ENABLED(cnx)) {
                                 bytes_next = picoquic_format_bdp_frame(cnx, bytes_next, bytes_max, path_x, &more_data, &is_pure_ack);
                             }
 
@@ -3150,7 +3999,8 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
                             && pmtu_discovery_needed != picoquic_pmtu_discovery_not_needed) {
                             if (send_buffer_max > path_x->send_mtu) {
                                 /* Since there is no data to send, this is an opportunity to send an MTU probe */
-                                length = picoquic_prepare_mtu_probe(cnx, path_x, header_length, checksum_overhead, bytes, send_buffer_max);
+                                length = picoquic_prepare_mtu_probe(cnx, path_x, header_length, checksum_overhead, bytes,
+                                    (send_buffer_max > packet->bytes_max) ? packet->bytes_max : send_buffer_max);
                                 packet->length = length;
                                 packet->send_path = path_x;
                                 packet->is_mtu_probe = 1;
@@ -3236,6 +4086,7 @@ int picoquic_prepare_packet_almost_ready(picoquic_cnx_t* cnx, picoquic_path_t* p
         if (picoquic_cnx_is_still_logging(cnx)) {
             picoquic_log_cc_dump(cnx, current_time);
         }
+        picoquic_cc_telemetry_record(cnx, path_x, current_time);
     }
 
     return ret;
@@ -3260,13 +4111,32 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     int more_data = 0;
     int ack_sent = 0;
     int is_challenge_padding_needed = 0;
-    int is_nominal_ack_path = (cnx->is_multipath_enabled) ?
+    int is_nominal_ack_path = (PICOQUIC_CNX_IS_MULTIPATH(cnx)) ?
         (path_x->is_nominal_ack_path || cnx->nb_paths == 1) : path_x == cnx->path[0];
 
-    picoquic_packet_context_t* pkt_ctx = (cnx->is_multipath_enabled) ?
+    picoquic_packet_context_t* pkt_ctx = (PICOQUIC_CNX_IS_MULTIPATH(cnx)) ?
         &path_x->pkt_ctx :
         &cnx->pkt_ctx[picoquic_packet_context_application];
 
+    /* After a fast port rebinding, the new port is not validated yet. As for
+     * any unvalidated address (RFC 9000, section 8), the bytes sent since the
+     * rebinding are capped at three times the bytes received since then, so
+     * a spoofed source port cannot turn the server into an amplifier. */
+    if (path_x->first_tuple->is_rebinding_pending) {
+        uint64_t budget = 3 * (path_x->received - path_x->first_tuple->rebinding_received_base);
+        uint64_t sent = path_x->bytes_sent - path_x->first_tuple->rebinding_sent_base;
+
+        budget = (budget > sent) ? budget - sent : 0;
+        if (budget < PICOQUIC_REBINDING_SEND_MIN) {
+            *send_length = 0;
+            return 0;
+        }
+        else if (budget < send_buffer_min_max) {
+            send_buffer_min_max = (size_t)budget;
+            bytes_max = bytes + send_buffer_min_max - checksum_overhead;
+        }
+    }
+
     /* Check whether to insert a hole in the sequence of packets */
     if (pkt_ctx->send_sequence >= pkt_ctx->next_sequence_hole) {
         picoquic_insert_hole_in_send_sequence_if_needed(cnx, path_x, pkt_ctx, current_time, next_wake_time);
@@ -3302,6 +4172,9 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                 cnx->pkt_ctx[picoquic_packet_context_application].send_sequence);
         }
     }
+    else {
+        picoquic_precompute_rotated_keys(cnx);
+    }
 
     /* The first action is normally to retransmit lost packets. These lost packets
      * are queued in the connection context as `cnx->data_repeat_first` when data 
@@ -3379,16 +4252,10 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
 
                 /* If necessary, encode the max data frame */
                 if (ret == 0){
-                    if (cnx->quic->max_data_limit != 0) {
-                        if (cnx->data_received + ((3 * cnx->quic->max_data_limit) / 4) > cnx->maxdata_local) {
-                            uint64_t max_data_increase = cnx->data_received + cnx->quic->max_data_limit - cnx->maxdata_local;
-                            bytes_next = picoquic_format_max_data_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack,
-                                max_data_increase);
-                        }
-                    }
-                    else if (2 * cnx->data_received > cnx->maxdata_local) {
+                    uint64_t max_data_increase = picoquic_cnx_max_data_increase(cnx);
+                    if (max_data_increase > 0) {
                         bytes_next = picoquic_format_max_data_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack,
-                            picoquic_cc_increased_window(cnx, cnx->maxdata_local));
+                            max_data_increase);
                     }
                 }
 
@@ -3409,10 +4276,16 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                 bytes_next = picoquic_format_misc_frames_in_context(cnx, bytes_next, bytes_max,
                     &more_data, &is_pure_ack, pc);
 
+                /* If a FEC block was just closed, send the repair frame */
+                if (cnx->fec_sender != NULL) {
+                    bytes_next = picoquic_format_fec_repair_frame(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack);
+                }
+
                 /* Compute the length before entering the CC block */
                 length = bytes_next - bytes;
 
-                if ((path_x->cwin < path_x->bytes_in_transit || cnx->quic->cwin_max < path_x->bytes_in_transit)
+                if ((path_x->cwin < path_x->bytes_in_transit || cnx->quic->cwin_max < path_x->bytes_in_transit ||
+                    (path_x->cc_group != NULL && picoquic_cc_manager_is_blocked(path_x, current_time, next_wake_time)))
                     && !path_x->is_pto_required) {
                     /* Implementation of experimental API, picoquic_set_priority_limit_for_bypass */
                     uint8_t* bytes_next_before_bypass = bytes_next;
@@ -3444,6 +4317,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                             cnx->congestion_alg->alg_notify(cnx, path_x,
                                 picoquic_congestion_notification_cwin_blocked,
                                 &ack_state, current_time);
+                            PICOQUIC_PROBE_CC_NOTIFY(cnx, path_x, picoquic_congestion_notification_cwin_blocked);
                         }
                     }
                 }
@@ -3464,7 +4338,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                             bytes_next, bytes_max, &more_data, &is_pure_ack);
                     }
 
-                    if (cnx->is_address_discovery_provider) {
+                    if (PICOQUIC_CNX_IS_ADDRESS_DISCOVERY_PROVIDER(cnx)) {
                         /* If a new address was learned, prepare an observed address frame */
                         /* TODO: tie this code to processing of paths */
                         bytes_next = picoquic_prepare_observed_address_frame(bytes_next, bytes_max,
@@ -3482,6 +4356,22 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                         if (ret == 0 && cnx->is_ack_frequency_updated && cnx->is_ack_frequency_negotiated) {
                             bytes_next = picoquic_format_ack_frequency_frame(cnx, bytes_next, bytes_max, &more_data);
                         }
+                        if (ret == 0 && cnx->is_immediate_ack_pending && cnx->is_ack_frequency_negotiated) {
+                            bytes_next = picoquic_format_immediate_ack_if_pending(cnx, bytes_next, bytes_max, &more_data, &is_pure_ack);
+                        }
+                        if (ret == 0 && cnx->is_redundant_repeat_pending && cnx->path_scheduler != NULL) {
+                            /* Repeat small packets sent on other paths before sending new data */
+                            size_t repeat_length = 0;
+
+                            ret = picoquic_redundant_repeat_as_needed(cnx, path_x, current_time, bytes_next,
+                                bytes_max - bytes_next, &repeat_length);
+                            if (repeat_length > 0) {
+                                preemptive_repeat = 1;
+                                packet->is_preemptive_repeat = 1;
+                                bytes_next += repeat_length;
+                                is_pure_ack = 0;
+                            }
+                        }
                         if (ret == 0) {
                             bytes_next = picoquic_prepare_stream_and_datagrams(cnx, path_x, bytes_next, bytes_max,
                                 UINT64_MAX, current_time, &more_data, &is_pure_ack, &no_data_to_send, &ret);
@@ -3490,7 +4380,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                         /* TODO: replace this by scheduling of BDP frame when window has been estimated */
                         /* Send bdp frames if there are no stream frames to send 
                          * and if peer wishes to receive bdp frames */
-                        if(!cnx->client_mode && cnx->send_receive_bdp_frame) {
+                        if(!cnx->client_mode && PICOQUIC_CNX_IS_BDP_FRAME_ENABLED(cnx)) {
                            bytes_next = picoquic_format_bdp_frame(cnx, bytes_next, bytes_max, path_x, &more_data, &is_pure_ack);
                         }
 
@@ -3558,7 +4448,8 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                             && cnx->quic->cwin_max > path_x->bytes_in_transit
                             && pmtu_discovery_needed != picoquic_pmtu_discovery_not_needed) {
                             /* Since there is no data to send, this is an opportunity to send an MTU probe */
-                            length = picoquic_prepare_mtu_probe(cnx, path_x, header_length, checksum_overhead, bytes, send_buffer_max);
+                            length = picoquic_prepare_mtu_probe(cnx, path_x, header_length, checksum_overhead, bytes,
+                                (send_buffer_max > packet->bytes_max) ? packet->bytes_max : send_buffer_max);
                             packet->length = length;
                             packet->send_path = path_x;
                             packet->is_mtu_probe = 1;
@@ -3623,7 +4514,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
                 }
             }
 
-            if (is_pure_ack && cnx->is_multipath_enabled && 
+            if (is_pure_ack && PICOQUIC_CNX_IS_MULTIPATH(cnx) && 
                 path_x->is_ack_lost && !path_x->is_ack_expected) {
                 /* In some multipath scenarios, we may need to ping a path if we see 
                  * non-ackable packets being lost. */
@@ -3698,6 +4589,7 @@ int picoquic_prepare_packet_ready(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
         if (ret == 0 && picoquic_cnx_is_still_logging(cnx)) {
             picoquic_log_cc_dump(cnx, current_time);
         }
+        picoquic_cc_telemetry_record(cnx, path_x, current_time);
     }
     return ret;
 }
@@ -3744,6 +4636,31 @@ static int picoquic_check_idle_timer(picoquic_cnx_t* cnx, uint64_t* next_wake_ti
     return ret;
 }
 
+/* Put the connection in hibernation if it has been quiet for long enough,
+ * or program a wake up at the time it would hibernate.
+ */
+static void picoquic_check_hibernation(picoquic_cnx_t* cnx, uint64_t current_time, uint64_t* next_wake_time)
+{
+    if (cnx->hibernation_delay > 0 && !cnx->is_hibernating && picoquic_is_cnx_quiet(cnx)) {
+        uint64_t last_activity_time = cnx->latest_receive_time;
+        uint64_t hibernation_time;
+
+        for (int i = 0; i < cnx->nb_paths; i++) {
+            if (cnx->path[i]->latest_sent_time > last_activity_time) {
+                last_activity_time = cnx->path[i]->latest_sent_time;
+            }
+        }
+        hibernation_time = last_activity_time + cnx->hibernation_delay;
+        if (current_time >= hibernation_time) {
+            picoquic_hibernate_cnx(cnx);
+        }
+        else if (hibernation_time < *next_wake_time) {
+            *next_wake_time = hibernation_time;
+            SET_LAST_WAKE(cnx->quic, PICOQUIC_SENDER);
+        }
+    }
+}
+
 /* Prepare next packet to send, or nothing.. */
 int picoquic_prepare_segment(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_t* packet,
     uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
@@ -3840,7 +4757,7 @@ static int picoquic_check_cc_feedback_timer(picoquic_cnx_t* cnx, uint64_t* next_
         for (int i = 0; i < cnx->nb_paths; i++) {
             picoquic_path_t* path_x = cnx->path[i];
             if (!path_x->is_lost_feedback_notified){
-                picoquic_packet_context_t* pkt_ctx = (cnx->is_multipath_enabled)?
+                picoquic_packet_context_t* pkt_ctx = (PICOQUIC_CNX_IS_MULTIPATH(cnx))?
                     &path_x->pkt_ctx:&cnx->pkt_ctx[picoquic_packet_context_application];
                 if (pkt_ctx->pending_first != NULL) {
                     uint64_t delta_sent = (pkt_ctx->pending_first->send_time <= path_x->last_time_acked_data_frame_sent) ? 0 :
@@ -3852,6 +4769,7 @@ static int picoquic_check_cc_feedback_timer(picoquic_cnx_t* cnx, uint64_t* next_
                         cnx->congestion_alg->alg_notify(cnx, path_x,
                             picoquic_congestion_notification_lost_feedback,
                             NULL, current_time);
+                        PICOQUIC_PROBE_CC_NOTIFY(cnx, path_x, picoquic_congestion_notification_lost_feedback);
                     }
                     else if (lost_feedback_time < *next_wake_time) {
                         *next_wake_time = lost_feedback_time;
@@ -3870,8 +4788,12 @@ int picoquic_handle_app_wake_time(picoquic_cnx_t* cnx, uint64_t current_time)
     while (cnx->app_wake_time != 0 && cnx->app_wake_time <= current_time){
         cnx->app_wake_time = 0;
         if (cnx->callback_fn != NULL) {
+            picoquic_cpu_mark_t cpu_mark;
+
+            picoquic_cpu_mark(cnx->quic, &cpu_mark);
             ret = cnx->callback_fn(cnx, current_time, NULL, 0, picoquic_callback_app_wakeup,
                 cnx->callback_ctx, NULL);
+            picoquic_cpu_account_app(cnx, &cpu_mark);
         }
     }
     return ret;
@@ -3889,6 +4811,36 @@ int picoquic_program_app_wake_time(picoquic_cnx_t* cnx, uint64_t* next_wake_time
 }
 
 /* Prepare next packet to send, or nothing.. */
+/* Earliest loss detection or PTO deadline of the connection, as computed
+ * when the retransmit queues were last evaluated, see loss_check_time.
+ * Timer coalescing must not postpone these deadlines.
+ */
+static uint64_t picoquic_get_loss_deadline(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    uint64_t loss_deadline = UINT64_MAX;
+
+    for (int pc = 0; pc < picoquic_nb_packet_context; pc++) {
+        picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[pc];
+
+        if (pkt_ctx->pending_first != NULL && pkt_ctx->loss_check_time > current_time &&
+            pkt_ctx->loss_check_time < loss_deadline) {
+            loss_deadline = pkt_ctx->loss_check_time;
+        }
+    }
+    if (PICOQUIC_CNX_IS_MULTIPATH(cnx)) {
+        for (int i = 0; i < cnx->nb_paths; i++) {
+            picoquic_packet_context_t* pkt_ctx = &cnx->path[i]->pkt_ctx;
+
+            if (pkt_ctx->pending_first != NULL && pkt_ctx->loss_check_time > current_time &&
+                pkt_ctx->loss_check_time < loss_deadline) {
+                loss_deadline = pkt_ctx->loss_check_time;
+            }
+        }
+    }
+
+    return loss_deadline;
+}
+
 int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
     uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
     struct sockaddr_storage * p_addr_to, struct sockaddr_storage * p_addr_from, int* if_index, size_t* send_msg_size)
@@ -3898,6 +4850,10 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
     picoquic_packet_t * packet = NULL;
     uint64_t initial_next_time;
     uint64_t next_wake_time = cnx->latest_receive_time + 2*PICOQUIC_MICROSEC_SILENCE_MAX;
+    picoquic_cpu_mark_t cpu_mark;
+
+    picoquic_cpu_mark(cnx->quic, &cpu_mark);
+    picoquic_cache_quic_time(cnx->quic, current_time);
 
     if (cnx->local_parameters.max_idle_timeout >(PICOQUIC_MICROSEC_SILENCE_MAX / 500)) {
         next_wake_time = cnx->latest_receive_time + cnx->local_parameters.max_idle_timeout * 1000ull;
@@ -3911,6 +4867,15 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
 
     *send_length = 0;
 
+    if (cnx->race_peer != NULL) {
+        picoquic_race_update(cnx, current_time);
+        if (cnx->race_start_time != 0) {
+            /* Secondary connection of a race, waiting for its start time */
+            picoquic_reinsert_by_wake_time(cnx->quic, cnx, cnx->race_start_time);
+            return 0;
+        }
+    }
+
     ret = picoquic_handle_app_wake_time(cnx, current_time);
 
     if (ret == 0) {
@@ -3984,7 +4949,7 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
                     }
                 }
 
-                packet = picoquic_create_packet(cnx->quic);
+                packet = picoquic_create_packet_ex(cnx->quic, picoquic_path_packet_size(cnx, path_x));
 
                 if (packet == NULL) {
                     ret = PICOQUIC_ERROR_MEMORY;
@@ -4008,13 +4973,22 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
                             picoquic_recycle_packet(cnx->quic, packet);
                             break;
                         }
-                        else if (packet->ptype == picoquic_packet_1rtt_protected) {
-                            /* Cannot coalesce packets after 1 rtt packet */
-                            break;
-                        }
-                        else if (segment_length == 0) {
-                            DBG_PRINTF("Send bug: segment length = %zu, packet length = %zu\n", segment_length, packet->length);
-                            break;
+                        else {
+                            int is_1rtt = (packet->ptype == picoquic_packet_1rtt_protected);
+                            size_t packet_length = packet->length;
+
+                            /* The packet is now queued, and will not be accessed by the segment loop */
+                            (void)picoquic_compact_queued_packet(cnx, path_x, packet);
+                            packet = NULL;
+
+                            if (is_1rtt) {
+                                /* Cannot coalesce packets after 1 rtt packet */
+                                break;
+                            }
+                            else if (segment_length == 0) {
+                                DBG_PRINTF("Send bug: segment length = %zu, packet length = %zu\n", segment_length, packet_length);
+                                break;
+                            }
                         }
                     }
                     else {
@@ -4044,6 +5018,16 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
                     cnx->max_mtu_sent = packet_size;
                 }
                 cnx->nb_packets_sent++;
+                if (cnx->quic->metrics != NULL) {
+                    cnx->quic->metrics->live.nb_packets_sent++;
+                }
+                if (*send_length == 0) {
+                    /* The batch leaves at the departure time of its first packet */
+                    cnx->departure_time_nanosec = current_time * 1000;
+                    if (path_x->pacing.last_departure_nanosec > cnx->departure_time_nanosec) {
+                        cnx->departure_time_nanosec = path_x->pacing.last_departure_nanosec;
+                    }
+                }
                 /* if needed, log that the packet is sent */
                 if (p_addr_to != NULL && p_addr_from != NULL) {
                     picoquic_log_pdu(cnx, 0, current_time,
@@ -4095,15 +5079,31 @@ int picoquic_prepare_packet_ex(picoquic_cnx_t* cnx,
         }
         if (*send_length > 0) {
             cnx->nb_trains_sent++;
+            if (cnx->is_hibernating) {
+                picoquic_rehydrate_cnx(cnx);
+            }
         }
+        else {
+            picoquic_check_hibernation(cnx, current_time, &next_wake_time);
+        }
+        picoquic_cnx_stats_record(cnx, current_time);
     }
 
     if (ret == 0) {
         ret = picoquic_program_app_wake_time(cnx, &next_wake_time);
     }
 
+    if (cnx->quic->timer_slack > 0) {
+        next_wake_time = picoquic_align_wake_time(cnx->quic, next_wake_time, current_time,
+            picoquic_get_loss_deadline(cnx, current_time));
+    }
     picoquic_reinsert_by_wake_time(cnx->quic, cnx, next_wake_time);
 
+    cnx->cpu_ticks_prepare += picoquic_cpu_elapsed(cnx->quic, &cpu_mark);
+
+    PICOQUIC_PROBE5(prepare_packet, cnx, *send_length, (send_msg_size == NULL) ? 0 : *send_msg_size,
+        next_wake_time, ret);
+
     return ret;
 }
 
@@ -4156,81 +5156,239 @@ void picoquic_close_immediate(picoquic_cnx_t* cnx)
  * will send a stateless packet if one is queued, or ask the first connection in
  * the wake list to prepare a packet */
 
+static void picoquic_prepare_stateless_next_packet(picoquic_quic_t* quic, picoquic_stateless_packet_t* sp,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
+    struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int* if_index,
+    picoquic_connection_id_t* log_cid)
+{
+    if (sp->length > send_buffer_max) {
+        *send_length = 0;
+    }
+    else {
+        memcpy(send_buffer, sp->bytes, sp->length);
+        *send_length = sp->length;
+        picoquic_store_addr(p_addr_to, (struct sockaddr*) & sp->addr_to);
+        picoquic_store_addr(p_addr_from, (struct sockaddr*) & sp->addr_local);
+        *if_index = sp->if_index_local;
+        if (log_cid != NULL) {
+            *log_cid = sp->initial_cid;
+        }
+    }
+    picoquic_delete_stateless_packet(quic, sp);
+}
+
+/* Prepare the next packet of the connection selected by the wake up list.
+ * If the connection is closed, server connections are deleted, and
+ * "is_deleted" is set so that the caller can forget the pointer. With
+ * compact closing, this happens as soon as the close has been sent.
+ */
+static int picoquic_prepare_cnx_next_packet(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
+    uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
+    struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int* if_index,
+    picoquic_connection_id_t* log_cid, picoquic_cnx_t** p_last_cnx, size_t* send_msg_size, int* is_deleted)
+{
+    int ret = picoquic_prepare_packet_ex(cnx, current_time, send_buffer, send_buffer_max, send_length, p_addr_to, p_addr_from,
+        if_index, send_msg_size);
+
+    *is_deleted = 0;
+    if (log_cid != NULL) {
+        *log_cid = cnx->initial_cnxid;
+    }
+
+    if (ret == PICOQUIC_ERROR_DISCONNECTED) {
+        ret = 0;
+
+        picoquic_log_app_message(cnx, "Closed. Retrans= %d, spurious= %d, max sp gap = %d, max sp delay = %d, dg-coal: %f",
+            (int)cnx->nb_retransmission_total, (int)cnx->nb_spurious,
+            (int)cnx->path[0]->max_reorder_gap, (int)cnx->path[0]->max_spurious_rtt,
+            (cnx->nb_trains_sent > 0) ? ((double)cnx->nb_packets_sent / (double)cnx->nb_trains_sent) : 0.0);
+
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(quic)) {
+            fflush(quic->F_log);
+        }
+
+        if (cnx->f_binlog != NULL && cnx->quic->binlog_async == NULL) {
+            /* The asynchronous writer owns the stream once records are queued */
+            fflush(cnx->f_binlog);
+        }
+
+        if (cnx->client_mode && !(cnx->is_race_secondary && cnx->is_race_loser)) {
+            /* Do not unilaterally delete the connection context, as it was set by the application */
+            picoquic_reinsert_by_wake_time(cnx->quic, cnx, UINT64_MAX);
+            SET_LAST_WAKE(cnx->quic, PICOQUIC_SENDER);
+        }
+        else {
+            if (cnx->race_peer != NULL) {
+                /* The stack created this connection to race the application's; keep the winner */
+                cnx->race_peer->race_peer = NULL;
+                cnx->race_peer = NULL;
+            }
+            picoquic_delete_cnx(cnx);
+            *is_deleted = 1;
+        }
+    }
+    else {
+        if (*if_index == -1) {
+            *if_index = picoquic_get_local_if_index(cnx);
+        }
+        if (ret == 0 && quic->tombstones != NULL && !cnx->client_mode && *send_length > 0 &&
+            (cnx->cnx_state == picoquic_state_closing || cnx->cnx_state == picoquic_state_draining)) {
+            /* The close was just sent. Keep a copy of the first datagram in a compact record,
+             * and free the connection context without waiting for the closing timer. */
+            size_t close_length = (send_msg_size != NULL && *send_msg_size > 0 && *send_msg_size < *send_length) ?
+                *send_msg_size : *send_length;
+
+            if (picoquic_tombstone_create(cnx, send_buffer, close_length, current_time) == 0) {
+                picoquic_delete_cnx(cnx);
+                *is_deleted = 1;
+            }
+        }
+        if (p_last_cnx && !*is_deleted) {
+            *p_last_cnx = cnx;
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_prepare_next_packet_ex(picoquic_quic_t* quic,
     uint64_t current_time, uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
     struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int * if_index,
     picoquic_connection_id_t * log_cid, picoquic_cnx_t** p_last_cnx, size_t * send_msg_size)
 {
     int ret = 0;
-    picoquic_stateless_packet_t* sp = picoquic_dequeue_stateless_packet(quic);
+    picoquic_stateless_packet_t* sp;
+
+    picoquic_cache_quic_time(quic, current_time);
+
+    if (quic->nb_parked_handshakes > 0) {
+        (void)picoquic_process_async_handshakes(quic, current_time);
+    }
+
+    if (quic->admission != NULL && quic->admission->nb_queued > 0) {
+        (void)picoquic_admission_process(quic, current_time);
+    }
+
+    if (quic->tombstones != NULL) {
+        picoquic_tombstone_purge(quic, current_time);
+    }
+
+    if (quic->metrics != NULL && current_time >= quic->metrics->next_publish_time) {
+        picoquic_publish_quic_metrics(quic, current_time);
+    }
+
+    sp = picoquic_dequeue_stateless_packet(quic);
 
     if (p_last_cnx) {
         *p_last_cnx = NULL;
     }
 
     if (sp != NULL) {
-        if (sp->length > send_buffer_max) {
-            *send_length = 0;
-        }
-        else {
-            memcpy(send_buffer, sp->bytes, sp->length);
-            *send_length = sp->length;
-            picoquic_store_addr(p_addr_to, (struct sockaddr*) & sp->addr_to);
-            picoquic_store_addr(p_addr_from, (struct sockaddr*) & sp->addr_local);
-            *if_index = sp->if_index_local;
-            if (log_cid != NULL) {
-                *log_cid = sp->initial_cid;
-            }
-        }
-        picoquic_delete_stateless_packet(sp);
+        picoquic_prepare_stateless_next_packet(quic, sp, send_buffer, send_buffer_max, send_length,
+            p_addr_to, p_addr_from, if_index, log_cid);
     }
     else {
-        picoquic_cnx_t* cnx = picoquic_get_earliest_cnx_to_wake(quic, current_time);
+        picoquic_cnx_t* cnx = (quic->egress != NULL) ? picoquic_egress_select(quic, current_time) :
+            picoquic_get_earliest_cnx_to_wake(quic, current_time);
 
         if (cnx == NULL) {
             *send_length = 0;
         }
         else {
-            ret = picoquic_prepare_packet_ex(cnx, current_time, send_buffer, send_buffer_max, send_length, p_addr_to, p_addr_from, 
-                if_index, send_msg_size);
-            if (log_cid != NULL) {
-                *log_cid = cnx->initial_cnxid;
+            int is_deleted = 0;
+            int egress_group = cnx->egress_group;
+            ret = picoquic_prepare_cnx_next_packet(quic, cnx, current_time, send_buffer, send_buffer_max, send_length,
+                p_addr_to, p_addr_from, if_index, log_cid, p_last_cnx, send_msg_size, &is_deleted);
+            if (quic->egress != NULL) {
+                picoquic_egress_charge(quic, egress_group, *send_length, current_time);
             }
+        }
+    }
 
-            if (ret == PICOQUIC_ERROR_DISCONNECTED) {
-                ret = 0;
+    if (quic->metrics != NULL) {
+        picoquic_metrics_datagrams_sent(quic, *send_length, (send_msg_size == NULL) ? 0 : *send_msg_size);
+    }
 
-                picoquic_log_app_message(cnx, "Closed. Retrans= %d, spurious= %d, max sp gap = %d, max sp delay = %d, dg-coal: %f",
-                    (int)cnx->nb_retransmission_total, (int)cnx->nb_spurious,
-                    (int)cnx->path[0]->max_reorder_gap, (int)cnx->path[0]->max_spurious_rtt,
-                    (cnx->nb_trains_sent > 0) ? ((double)cnx->nb_packets_sent / (double)cnx->nb_trains_sent) : 0.0);
+    return ret;
+}
 
-                if (quic->F_log != NULL) {
-                    fflush(quic->F_log);
-                }
+int picoquic_prepare_next_packets(picoquic_quic_t* quic, uint64_t current_time,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t send_msg_max,
+    picoquic_send_desc_t* desc, size_t nb_desc_max, size_t* nb_desc)
+{
+    int ret = 0;
+    size_t offset = 0;
+    size_t nb_idle = 0;
 
-                if (cnx->f_binlog != NULL) {
-                    fflush(cnx->f_binlog);
-                }
+    if (send_msg_max < PICOQUIC_MAX_PACKET_SIZE) {
+        send_msg_max = PICOQUIC_MAX_PACKET_SIZE;
+    }
+    *nb_desc = 0;
 
-                if (cnx->client_mode) {
-                    /* Do not unilaterally delete the connection context, as it was set by the application */
-                    picoquic_reinsert_by_wake_time(cnx->quic, cnx, UINT64_MAX);
-                    SET_LAST_WAKE(cnx->quic, PICOQUIC_SENDER);
-                }
-                else {
-                    picoquic_delete_cnx(cnx);
-                }
+    if (quic->tombstones != NULL) {
+        picoquic_tombstone_purge(quic, current_time);
+    }
+
+    if (quic->metrics != NULL && current_time >= quic->metrics->next_publish_time) {
+        picoquic_publish_quic_metrics(quic, current_time);
+    }
+
+    while (ret == 0 && *nb_desc < nb_desc_max && send_buffer_max - offset >= PICOQUIC_MAX_PACKET_SIZE) {
+        picoquic_send_desc_t* d = &desc[*nb_desc];
+        size_t slice_max = send_buffer_max - offset;
+        size_t send_msg_size = 0;
+        picoquic_stateless_packet_t* sp = picoquic_dequeue_stateless_packet(quic);
+
+        if (slice_max > send_msg_max) {
+            slice_max = send_msg_max;
+        }
+        d->buffer = send_buffer + offset;
+        d->length = 0;
+        d->if_index = -1;
+        d->cnx = NULL;
+
+        if (sp != NULL) {
+            picoquic_prepare_stateless_next_packet(quic, sp, d->buffer, slice_max, &d->length,
+                &d->addr_to, &d->addr_from, &d->if_index, &d->log_cid);
+        }
+        else {
+            picoquic_cnx_t* cnx = (quic->egress != NULL) ? picoquic_egress_select(quic, current_time) :
+                picoquic_get_earliest_cnx_to_wake(quic, current_time);
+            int is_deleted = 0;
+            int egress_group;
+
+            if (cnx == NULL) {
+                /* No connection is ready before current time */
+                break;
             }
-            else {
-                if (*if_index == -1) {
-                    *if_index = picoquic_get_local_if_index(cnx);
-                }
-                if (p_last_cnx) {
-                    *p_last_cnx = cnx;
+            egress_group = cnx->egress_group;
+            ret = picoquic_prepare_cnx_next_packet(quic, cnx, current_time, d->buffer, slice_max, &d->length,
+                &d->addr_to, &d->addr_from, &d->if_index, &d->log_cid, &d->cnx, &send_msg_size, &is_deleted);
+            if (quic->egress != NULL) {
+                picoquic_egress_charge(quic, egress_group, d->length, current_time);
+            }
+            if (is_deleted) {
+                /* Packets already prepared for that connection remain valid */
+                for (size_t i = 0; i < *nb_desc; i++) {
+                    if (desc[i].cnx == cnx) {
+                        desc[i].cnx = NULL;
+                    }
                 }
             }
         }
+
+        if (d->length > 0) {
+            d->segment_size = (send_msg_size == 0) ? d->length : send_msg_size;
+            offset += d->length;
+            if (quic->metrics != NULL) {
+                picoquic_metrics_datagrams_sent(quic, d->length, d->segment_size);
+            }
+            *nb_desc += 1;
+        }
+        else if (++nb_idle > nb_desc_max) {
+            /* Connections woke up without sending, avoid spinning */
+            break;
+        }
     }
 
     return ret;
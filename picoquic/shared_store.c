@@ -0,0 +1,558 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Shared store of session tickets and retry tokens.
+*
+* Client processes that attach the same file share the tickets and NEW_TOKEN
+* tokens that any of them received. The file is mapped in memory, and holds a
+* header followed by a fixed number of slots. Each slot contains one record,
+* serialized as in the ticket and token files.
+*
+* Slots are located by hashing the lookup key with a seed kept in the header,
+* (SNI, ALPN) for tickets and SNI for tokens, and probing a small window from
+* there. Each slot is protected by a sequence number, which is odd while a
+* writer updates the slot. Writers claim the slot with a compare and swap, so
+* concurrent writers never mix their records; readers copy the slot and
+* retry if the sequence number changed during the copy.
+*
+* The shared store complements the local store of each context: tickets and
+* tokens are published when stored, looked up when the local store has no
+* match, and removed from the shared store when a context uses them, so that
+* two processes do not attempt 0-RTT with the same ticket.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "tls_api.h"
+
+#define PICOQUIC_SHARED_STORE_MAGIC 0x50515353
+#define PICOQUIC_SHARED_STORE_INIT 0x50515300
+#define PICOQUIC_SHARED_STORE_FORMAT 1
+#define PICOQUIC_SHARED_STORE_RECORD_MAX 2048
+#define PICOQUIC_SHARED_STORE_PROBE 8
+#define PICOQUIC_SHARED_STORE_INIT_WAIT 100000
+
+#define PICOQUIC_SHARED_KIND_TICKET 1
+#define PICOQUIC_SHARED_KIND_TOKEN 2
+
+typedef struct st_picoquic_shared_header_t {
+    volatile uint32_t magic;
+    uint32_t format;
+    uint64_t nb_slots;
+    uint8_t hash_seed[16];
+    uint8_t reserved[32];
+} picoquic_shared_header_t;
+
+typedef struct st_picoquic_shared_slot_t {
+    volatile uint32_t seq;
+    uint32_t kind;
+    uint64_t group_hash;
+    uint64_t identity_hash;
+    uint64_t time_valid_until;
+    uint32_t record_length;
+    uint32_t reserved;
+    uint8_t record[PICOQUIC_SHARED_STORE_RECORD_MAX];
+} picoquic_shared_slot_t;
+
+typedef struct st_picoquic_shared_store_t {
+    uint8_t* base;
+    size_t map_size;
+    size_t nb_slots;
+#ifdef _WINDOWS
+    HANDLE file_handle;
+    HANDLE map_handle;
+#else
+    int fd;
+#endif
+} picoquic_shared_store_t;
+
+#ifdef _WINDOWS
+#define PICOQUIC_SHARED_LOAD(p) ((uint32_t)InterlockedCompareExchange((LONG volatile*)(p), 0, 0))
+#define PICOQUIC_SHARED_STORE_SEQ(p, v) (void)InterlockedExchange((LONG volatile*)(p), (LONG)(v))
+#define PICOQUIC_SHARED_CAS(p, e, v) (InterlockedCompareExchange((LONG volatile*)(p), (LONG)(v), (LONG)(e)) == (LONG)(e))
+#define PICOQUIC_SHARED_FENCE() MemoryBarrier()
+#define PICOQUIC_SHARED_YIELD() Sleep(0)
+#else
+#define PICOQUIC_SHARED_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PICOQUIC_SHARED_STORE_SEQ(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+static int picoquic_shared_cas(volatile uint32_t* p, uint32_t expected, uint32_t v)
+{
+    return __atomic_compare_exchange_n(p, &expected, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+#define PICOQUIC_SHARED_CAS(p, e, v) picoquic_shared_cas((p), (e), (v))
+#define PICOQUIC_SHARED_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define PICOQUIC_SHARED_YIELD() (void)sched_yield()
+#endif
+
+static picoquic_shared_header_t* picoquic_shared_header(picoquic_shared_store_t* store)
+{
+    return (picoquic_shared_header_t*)store->base;
+}
+
+static picoquic_shared_slot_t* picoquic_shared_slot(picoquic_shared_store_t* store, size_t slot_id)
+{
+    return ((picoquic_shared_slot_t*)(store->base + sizeof(picoquic_shared_header_t))) + slot_id;
+}
+
+static size_t picoquic_shared_map_size(size_t nb_slots)
+{
+    return sizeof(picoquic_shared_header_t) + nb_slots * sizeof(picoquic_shared_slot_t);
+}
+
+static void picoquic_shared_store_unmap(picoquic_shared_store_t* store)
+{
+#ifdef _WINDOWS
+    if (store->base != NULL) {
+        (void)UnmapViewOfFile(store->base);
+    }
+    if (store->map_handle != NULL) {
+        (void)CloseHandle(store->map_handle);
+    }
+    if (store->file_handle != INVALID_HANDLE_VALUE) {
+        (void)CloseHandle(store->file_handle);
+    }
+#else
+    if (store->base != NULL) {
+        (void)munmap(store->base, store->map_size);
+    }
+    if (store->fd >= 0) {
+        (void)close(store->fd);
+    }
+#endif
+    free(store);
+}
+
+/* Open or create the file, and map it. The file is extended to the expected
+ * size if it is shorter, which is harmless if several processes do it at
+ * the same time. */
+static picoquic_shared_store_t* picoquic_shared_store_map(char const* file_name, size_t nb_slots)
+{
+    picoquic_shared_store_t* store = (picoquic_shared_store_t*)malloc(sizeof(picoquic_shared_store_t));
+
+    if (store != NULL) {
+        int ret = 0;
+
+        memset(store, 0, sizeof(picoquic_shared_store_t));
+        store->nb_slots = nb_slots;
+        store->map_size = picoquic_shared_map_size(nb_slots);
+#ifdef _WINDOWS
+        store->file_handle = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (store->file_handle == INVALID_HANDLE_VALUE) {
+            ret = -1;
+        }
+        else {
+            LARGE_INTEGER file_size;
+
+            if (!GetFileSizeEx(store->file_handle, &file_size) ||
+                ((uint64_t)file_size.QuadPart != 0 && (uint64_t)file_size.QuadPart != (uint64_t)store->map_size)) {
+                ret = PICOQUIC_ERROR_INVALID_FILE;
+            }
+            else {
+                /* The mapping extends the file to the requested size */
+                store->map_handle = CreateFileMappingA(store->file_handle, NULL, PAGE_READWRITE,
+                    (DWORD)(((uint64_t)store->map_size) >> 32), (DWORD)(store->map_size & 0xFFFFFFFF), NULL);
+                if (store->map_handle == NULL ||
+                    (store->base = (uint8_t*)MapViewOfFile(store->map_handle, FILE_MAP_ALL_ACCESS, 0, 0, store->map_size)) == NULL) {
+                    ret = -1;
+                }
+            }
+        }
+#else
+        store->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+        if (store->fd < 0) {
+            ret = -1;
+        }
+        else {
+            struct stat st;
+
+            if (fstat(store->fd, &st) != 0 ||
+                (st.st_size != 0 && (uint64_t)st.st_size != (uint64_t)store->map_size)) {
+                ret = PICOQUIC_ERROR_INVALID_FILE;
+            }
+            else if (st.st_size == 0 && ftruncate(store->fd, (off_t)store->map_size) != 0) {
+                ret = -1;
+            }
+            else {
+                store->base = (uint8_t*)mmap(NULL, store->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+                if (store->base == (uint8_t*)MAP_FAILED) {
+                    store->base = NULL;
+                    ret = -1;
+                }
+            }
+        }
+#endif
+        if (ret != 0) {
+            DBG_PRINTF("Cannot map shared ticket store <%s>, ret = 0x%x", file_name, ret);
+            picoquic_shared_store_unmap(store);
+            store = NULL;
+        }
+    }
+
+    return store;
+}
+
+/* The first process to map the file sets the header. The others wait until
+ * the header is complete, then verify that it matches their parameters. */
+static int picoquic_shared_store_init_header(picoquic_quic_t* quic, picoquic_shared_store_t* store)
+{
+    int ret = 0;
+    picoquic_shared_header_t* header = picoquic_shared_header(store);
+
+    if (PICOQUIC_SHARED_CAS(&header->magic, 0, PICOQUIC_SHARED_STORE_INIT)) {
+        header->format = PICOQUIC_SHARED_STORE_FORMAT;
+        header->nb_slots = store->nb_slots;
+        picoquic_crypto_random(quic, header->hash_seed, sizeof(header->hash_seed));
+        PICOQUIC_SHARED_STORE_SEQ(&header->magic, PICOQUIC_SHARED_STORE_MAGIC);
+    }
+    else {
+        int nb_wait = 0;
+
+        while (PICOQUIC_SHARED_LOAD(&header->magic) == PICOQUIC_SHARED_STORE_INIT &&
+            nb_wait < PICOQUIC_SHARED_STORE_INIT_WAIT) {
+            PICOQUIC_SHARED_YIELD();
+            nb_wait++;
+        }
+        if (PICOQUIC_SHARED_LOAD(&header->magic) != PICOQUIC_SHARED_STORE_MAGIC ||
+            header->format != PICOQUIC_SHARED_STORE_FORMAT ||
+            header->nb_slots != (uint64_t)store->nb_slots) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_attach_shared_ticket_store(picoquic_quic_t* quic, char const* file_name, size_t nb_slots)
+{
+    int ret = 0;
+
+    picoquic_detach_shared_ticket_store(quic);
+
+    if (file_name == NULL || nb_slots == 0 ||
+        nb_slots > (SIZE_MAX - sizeof(picoquic_shared_header_t)) / sizeof(picoquic_shared_slot_t)) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        picoquic_shared_store_t* store = picoquic_shared_store_map(file_name, nb_slots);
+
+        if (store == NULL) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else if ((ret = picoquic_shared_store_init_header(quic, store)) != 0) {
+            DBG_PRINTF("Shared ticket store <%s> does not match %zu slots", file_name, nb_slots);
+            picoquic_shared_store_unmap(store);
+        }
+        else {
+            quic->shared_store = store;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_detach_shared_ticket_store(picoquic_quic_t* quic)
+{
+    if (quic->shared_store != NULL) {
+        picoquic_shared_store_unmap(quic->shared_store);
+        quic->shared_store = NULL;
+    }
+}
+
+/* Hashes of the lookup key and of the record identity. The group hash
+ * selects the slots, the identity hash finds the record replaced by a
+ * newer version. */
+static uint64_t picoquic_shared_hash(picoquic_shared_store_t* store, const void* bytes, size_t length)
+{
+    return picohash_siphash((const uint8_t*)bytes, length, picoquic_shared_header(store)->hash_seed);
+}
+
+static uint64_t picoquic_shared_ticket_group(picoquic_shared_store_t* store,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length)
+{
+    return picoquic_shared_hash(store, sni, sni_length) ^
+        (picoquic_shared_hash(store, alpn, alpn_length) * 0x9E3779B97F4A7C15ull);
+}
+
+static uint64_t picoquic_shared_token_group(picoquic_shared_store_t* store, char const* sni, uint16_t sni_length)
+{
+    return picoquic_shared_hash(store, sni, sni_length) ^ 0xC2B2AE3D27D4EB4Full;
+}
+
+static uint64_t picoquic_shared_identity(picoquic_shared_store_t* store, uint64_t group_hash,
+    uint8_t const* discriminator, size_t discriminator_length)
+{
+    return group_hash ^ (picoquic_shared_hash(store, discriminator, discriminator_length) * 0xFF51AFD7ED558CCDull);
+}
+
+static uint64_t picoquic_shared_ticket_identity(picoquic_shared_store_t* store, uint64_t group_hash, uint32_t version)
+{
+    uint8_t v[4];
+
+    picoformat_32(v, version);
+    return picoquic_shared_identity(store, group_hash, v, sizeof(v));
+}
+
+/* Write a record in the probe window: replace the same identity if present,
+ * else use a free or expired slot, else the slot that expires first. */
+static void picoquic_shared_store_put(picoquic_shared_store_t* store, uint32_t kind,
+    uint64_t group_hash, uint64_t identity_hash, uint64_t time_valid_until, uint64_t current_time,
+    const uint8_t* record, size_t record_length)
+{
+    picoquic_shared_slot_t* target = NULL;
+    picoquic_shared_slot_t* oldest = NULL;
+    size_t first_slot = (size_t)(group_hash % store->nb_slots);
+
+    for (size_t i = 0; i < PICOQUIC_SHARED_STORE_PROBE && i < store->nb_slots; i++) {
+        picoquic_shared_slot_t* slot = picoquic_shared_slot(store, (first_slot + i) % store->nb_slots);
+
+        if (slot->kind == kind && slot->identity_hash == identity_hash) {
+            target = (slot->time_valid_until <= time_valid_until) ? slot : NULL;
+            oldest = NULL;
+            break;
+        }
+        else if (slot->kind == 0 || slot->time_valid_until <= current_time) {
+            if (target == NULL) {
+                target = slot;
+            }
+        }
+        else if (oldest == NULL || slot->time_valid_until < oldest->time_valid_until) {
+            oldest = slot;
+        }
+    }
+    if (target == NULL) {
+        target = oldest;
+    }
+
+    if (target != NULL) {
+        uint32_t seq = PICOQUIC_SHARED_LOAD(&target->seq);
+
+        if ((seq & 1) == 0 && PICOQUIC_SHARED_CAS(&target->seq, seq, seq + 1)) {
+            target->kind = kind;
+            target->group_hash = group_hash;
+            target->identity_hash = identity_hash;
+            target->time_valid_until = time_valid_until;
+            target->record_length = (uint32_t)record_length;
+            memcpy(target->record, record, record_length);
+            PICOQUIC_SHARED_STORE_SEQ(&target->seq, seq + 2);
+        }
+        /* else, another process is writing the slot, and wins. */
+    }
+}
+
+static void picoquic_shared_store_remove(picoquic_shared_store_t* store, uint32_t kind,
+    uint64_t group_hash, uint64_t identity_hash)
+{
+    size_t first_slot = (size_t)(group_hash % store->nb_slots);
+
+    for (size_t i = 0; i < PICOQUIC_SHARED_STORE_PROBE && i < store->nb_slots; i++) {
+        picoquic_shared_slot_t* slot = picoquic_shared_slot(store, (first_slot + i) % store->nb_slots);
+
+        if (slot->kind == kind && slot->identity_hash == identity_hash) {
+            uint32_t seq = PICOQUIC_SHARED_LOAD(&slot->seq);
+
+            if ((seq & 1) == 0 && PICOQUIC_SHARED_CAS(&slot->seq, seq, seq + 1)) {
+                if (slot->kind == kind && slot->identity_hash == identity_hash) {
+                    slot->kind = 0;
+                    slot->time_valid_until = 0;
+                    slot->record_length = 0;
+                }
+                PICOQUIC_SHARED_STORE_SEQ(&slot->seq, seq + 2);
+            }
+            break;
+        }
+    }
+}
+
+/* Copy a consistent image of the slot if it holds a valid record of the group.
+ * Returns the record length, or 0 if the slot cannot be used. */
+static size_t picoquic_shared_store_read(picoquic_shared_slot_t* slot, uint32_t kind, uint64_t group_hash,
+    uint64_t current_time, uint8_t* record, uint64_t* time_valid_until)
+{
+    size_t record_length = 0;
+    uint32_t seq = PICOQUIC_SHARED_LOAD(&slot->seq);
+
+    if ((seq & 1) == 0 && slot->kind == kind && slot->group_hash == group_hash &&
+        slot->time_valid_until > current_time && slot->record_length <= PICOQUIC_SHARED_STORE_RECORD_MAX) {
+        record_length = slot->record_length;
+        *time_valid_until = slot->time_valid_until;
+        memcpy(record, slot->record, record_length);
+        PICOQUIC_SHARED_FENCE();
+        if (PICOQUIC_SHARED_LOAD(&slot->seq) != seq) {
+            record_length = 0;
+        }
+    }
+
+    return record_length;
+}
+
+void picoquic_shared_store_publish_ticket(picoquic_quic_t* quic, const picoquic_stored_ticket_t* stored)
+{
+    picoquic_shared_store_t* store = quic->shared_store;
+    uint8_t record[PICOQUIC_SHARED_STORE_RECORD_MAX];
+    size_t record_length = 0;
+
+    if (store != NULL &&
+        picoquic_serialize_ticket(stored, record, sizeof(record), &record_length) == 0) {
+        uint64_t group_hash = picoquic_shared_ticket_group(store, stored->sni, stored->sni_length,
+            stored->alpn, stored->alpn_length);
+        picoquic_shared_store_put(store, PICOQUIC_SHARED_KIND_TICKET, group_hash,
+            picoquic_shared_ticket_identity(store, group_hash, stored->version),
+            stored->time_valid_until, picoquic_get_tls_time(quic), record, record_length);
+    }
+}
+
+void picoquic_shared_store_forget_ticket(picoquic_quic_t* quic, const picoquic_stored_ticket_t* stored)
+{
+    picoquic_shared_store_t* store = quic->shared_store;
+
+    if (store != NULL) {
+        uint64_t group_hash = picoquic_shared_ticket_group(store, stored->sni, stored->sni_length,
+            stored->alpn, stored->alpn_length);
+        picoquic_shared_store_remove(store, PICOQUIC_SHARED_KIND_TICKET, group_hash,
+            picoquic_shared_ticket_identity(store, group_hash, stored->version));
+    }
+}
+
+picoquic_stored_ticket_t* picoquic_shared_store_fetch_ticket(picoquic_quic_t* quic,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
+    uint32_t version, uint64_t ticket_id)
+{
+    picoquic_shared_store_t* store = quic->shared_store;
+    picoquic_stored_ticket_t* found = NULL;
+
+    if (store != NULL) {
+        uint64_t current_time = picoquic_get_tls_time(quic);
+        uint64_t group_hash = picoquic_shared_ticket_group(store, sni, sni_length, alpn, alpn_length);
+        size_t first_slot = (size_t)(group_hash % store->nb_slots);
+        uint8_t record[PICOQUIC_SHARED_STORE_RECORD_MAX];
+
+        for (size_t i = 0; found == NULL && i < PICOQUIC_SHARED_STORE_PROBE && i < store->nb_slots; i++) {
+            uint64_t time_valid_until = 0;
+            size_t consumed = 0;
+            size_t record_length = picoquic_shared_store_read(picoquic_shared_slot(store, (first_slot + i) % store->nb_slots),
+                PICOQUIC_SHARED_KIND_TICKET, group_hash, current_time, record, &time_valid_until);
+
+            if (record_length > 0 &&
+                picoquic_deserialize_ticket(&found, record, record_length, &consumed) == 0 && found != NULL) {
+                uint64_t stored_id = (found->ticket_length < 8) ? 0 : PICOPARSE_64(found->ticket);
+
+                if (found->time_valid_until <= current_time ||
+                    found->sni_length != sni_length || memcmp(found->sni, sni, sni_length) != 0 ||
+                    found->alpn_length != alpn_length || memcmp(found->alpn, alpn, alpn_length) != 0 ||
+                    (version != 0 && found->version != version) ||
+                    (ticket_id != 0 && stored_id != ticket_id)) {
+                    free(found);
+                    found = NULL;
+                }
+            }
+            else if (found != NULL) {
+                free(found);
+                found = NULL;
+            }
+        }
+    }
+
+    return found;
+}
+
+void picoquic_shared_store_publish_token(picoquic_quic_t* quic, const picoquic_stored_token_t* stored)
+{
+    picoquic_shared_store_t* store = quic->shared_store;
+    uint8_t record[PICOQUIC_SHARED_STORE_RECORD_MAX];
+    size_t record_length = 0;
+
+    if (store != NULL &&
+        picoquic_serialize_token(stored, record, sizeof(record), &record_length) == 0) {
+        uint64_t group_hash = picoquic_shared_token_group(store, stored->sni, stored->sni_length);
+        picoquic_shared_store_put(store, PICOQUIC_SHARED_KIND_TOKEN, group_hash,
+            picoquic_shared_identity(store, group_hash, stored->ip_addr, stored->ip_addr_length),
+            stored->time_valid_until, picoquic_get_tls_time(quic), record, record_length);
+    }
+}
+
+void picoquic_shared_store_forget_token(picoquic_quic_t* quic, const picoquic_stored_token_t* stored)
+{
+    picoquic_shared_store_t* store = quic->shared_store;
+
+    if (store != NULL) {
+        uint64_t group_hash = picoquic_shared_token_group(store, stored->sni, stored->sni_length);
+        picoquic_shared_store_remove(store, PICOQUIC_SHARED_KIND_TOKEN, group_hash,
+            picoquic_shared_identity(store, group_hash, stored->ip_addr, stored->ip_addr_length));
+    }
+}
+
+/* If no IP address is specified, return the matching token valid for the
+ * longest time, as the local lookup does. */
+picoquic_stored_token_t* picoquic_shared_store_fetch_token(picoquic_quic_t* quic,
+    char const* sni, uint16_t sni_length, uint8_t const* ip_addr, uint8_t ip_addr_length)
+{
+    picoquic_shared_store_t* store = quic->shared_store;
+    picoquic_stored_token_t* best_match = NULL;
+
+    if (store != NULL) {
+        uint64_t current_time = picoquic_get_tls_time(quic);
+        uint64_t group_hash = picoquic_shared_token_group(store, sni, sni_length);
+        size_t first_slot = (size_t)(group_hash % store->nb_slots);
+        uint8_t record[PICOQUIC_SHARED_STORE_RECORD_MAX];
+
+        for (size_t i = 0; i < PICOQUIC_SHARED_STORE_PROBE && i < store->nb_slots; i++) {
+            picoquic_stored_token_t* candidate = NULL;
+            uint64_t time_valid_until = 0;
+            size_t consumed = 0;
+            size_t record_length = picoquic_shared_store_read(picoquic_shared_slot(store, (first_slot + i) % store->nb_slots),
+                PICOQUIC_SHARED_KIND_TOKEN, group_hash, current_time, record, &time_valid_until);
+
+            if (record_length > 0 &&
+                picoquic_deserialize_token(&candidate, record, record_length, &consumed) == 0 && candidate != NULL &&
+                candidate->time_valid_until > current_time && candidate->token_length > 0 &&
+                candidate->sni_length == sni_length && memcmp(candidate->sni, sni, sni_length) == 0 &&
+                (ip_addr_length == 0 ||
+                (candidate->ip_addr_length == ip_addr_length && memcmp(candidate->ip_addr, ip_addr, ip_addr_length) == 0)) &&
+                (best_match == NULL || candidate->time_valid_until > best_match->time_valid_until)) {
+                if (best_match != NULL) {
+                    free(best_match);
+                }
+                best_match = candidate;
+                candidate = NULL;
+            }
+            if (candidate != NULL) {
+                free(candidate);
+            }
+            if (best_match != NULL && ip_addr_length > 0) {
+                break;
+            }
+        }
+    }
+
+    return best_match;
+}
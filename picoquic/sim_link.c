@@ -73,7 +73,11 @@ void picoquictest_sim_link_delete(picoquictest_sim_link_t* link)
 
     while ((packet = link->first_packet) != NULL) {
         link->first_packet = packet->next_packet;
-        free(packet);
+        picoquictest_sim_pool_release_packet(link->pool, packet);
+    }
+
+    if (link->sched != NULL) {
+        picoquictest_sim_sched_update(link->sched, link->sched_slot, UINT64_MAX);
     }
 
     free(link);
@@ -92,6 +96,167 @@ picoquictest_sim_packet_t* picoquictest_sim_link_create_packet()
     return packet;
 }
 
+picoquictest_sim_packet_t* picoquictest_sim_pool_get_packet(picoquictest_sim_packet_pool_t* pool)
+{
+    picoquictest_sim_packet_t* packet;
+
+    if (pool == NULL || pool->first_free == NULL) {
+        packet = picoquictest_sim_link_create_packet();
+    }
+    else {
+        packet = pool->first_free;
+        pool->first_free = packet->next_packet;
+        pool->nb_free--;
+        packet->next_packet = NULL;
+        packet->arrival_time = 0;
+        packet->length = 0;
+        packet->ecn_mark = 0;
+        packet->addr_from.ss_family = 0;
+        packet->addr_to.ss_family = 0;
+    }
+
+    return packet;
+}
+
+void picoquictest_sim_pool_release_packet(picoquictest_sim_packet_pool_t* pool, picoquictest_sim_packet_t* packet)
+{
+    if (pool == NULL || pool->nb_free >= pool->nb_free_max) {
+        free(packet);
+    }
+    else {
+        packet->next_packet = pool->first_free;
+        pool->first_free = packet;
+        pool->nb_free++;
+    }
+}
+
+void picoquictest_sim_pool_clear(picoquictest_sim_packet_pool_t* pool)
+{
+    picoquictest_sim_packet_t* packet;
+
+    while ((packet = pool->first_free) != NULL) {
+        pool->first_free = packet->next_packet;
+        free(packet);
+    }
+    pool->nb_free = 0;
+}
+
+/* The scheduler heap is stored in an array, the children of the slot
+ * at position i are at positions 2i+1 and 2i+2.
+ */
+static int picoquictest_sim_sched_is_before(picoquictest_sim_sched_t* sched, size_t slot_a, size_t slot_b)
+{
+    return (sched->wake_time[slot_a] < sched->wake_time[slot_b] ||
+        (sched->wake_time[slot_a] == sched->wake_time[slot_b] && slot_a < slot_b));
+}
+
+static void picoquictest_sim_sched_swap(picoquictest_sim_sched_t* sched, size_t pos_a, size_t pos_b)
+{
+    size_t slot_a = sched->heap[pos_a];
+    size_t slot_b = sched->heap[pos_b];
+
+    sched->heap[pos_a] = slot_b;
+    sched->heap[pos_b] = slot_a;
+    sched->heap_position[slot_a] = pos_b;
+    sched->heap_position[slot_b] = pos_a;
+}
+
+int picoquictest_sim_sched_init(picoquictest_sim_sched_t* sched, size_t nb_slots)
+{
+    int ret = 0;
+
+    memset(sched, 0, sizeof(picoquictest_sim_sched_t));
+    if (nb_slots > 0) {
+        sched->wake_time = (uint64_t*)malloc(nb_slots * sizeof(uint64_t));
+        sched->heap = (size_t*)malloc(nb_slots * sizeof(size_t));
+        sched->heap_position = (size_t*)malloc(nb_slots * sizeof(size_t));
+
+        if (sched->wake_time == NULL || sched->heap == NULL || sched->heap_position == NULL) {
+            picoquictest_sim_sched_clear(sched);
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            sched->nb_slots = nb_slots;
+            for (size_t i = 0; i < nb_slots; i++) {
+                sched->wake_time[i] = UINT64_MAX;
+                sched->heap[i] = i;
+                sched->heap_position[i] = i;
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquictest_sim_sched_clear(picoquictest_sim_sched_t* sched)
+{
+    if (sched->wake_time != NULL) {
+        free(sched->wake_time);
+    }
+    if (sched->heap != NULL) {
+        free(sched->heap);
+    }
+    if (sched->heap_position != NULL) {
+        free(sched->heap_position);
+    }
+    memset(sched, 0, sizeof(picoquictest_sim_sched_t));
+}
+
+void picoquictest_sim_sched_update(picoquictest_sim_sched_t* sched, size_t slot, uint64_t wake_time)
+{
+    if (slot < sched->nb_slots) {
+        size_t pos = sched->heap_position[slot];
+
+        sched->wake_time[slot] = wake_time;
+        /* Move the slot up if it is now before its parent */
+        while (pos > 0 && picoquictest_sim_sched_is_before(sched, slot, sched->heap[(pos - 1) / 2])) {
+            picoquictest_sim_sched_swap(sched, pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
+        }
+        /* Move the slot down if one of its children is now before it */
+        while (2 * pos + 1 < sched->nb_slots) {
+            size_t child = 2 * pos + 1;
+
+            if (child + 1 < sched->nb_slots &&
+                picoquictest_sim_sched_is_before(sched, sched->heap[child + 1], sched->heap[child])) {
+                child++;
+            }
+            if (!picoquictest_sim_sched_is_before(sched, sched->heap[child], slot)) {
+                break;
+            }
+            picoquictest_sim_sched_swap(sched, pos, child);
+            pos = child;
+        }
+    }
+}
+
+uint64_t picoquictest_sim_sched_next(picoquictest_sim_sched_t* sched, size_t* slot)
+{
+    uint64_t wake_time = UINT64_MAX;
+
+    if (sched->nb_slots > 0) {
+        *slot = sched->heap[0];
+        wake_time = sched->wake_time[*slot];
+    }
+
+    return wake_time;
+}
+
+void picoquictest_sim_link_set_sched(picoquictest_sim_link_t* link, picoquictest_sim_sched_t* sched, size_t sched_slot)
+{
+    link->sched = sched;
+    link->sched_slot = sched_slot;
+    picoquictest_sim_link_sched_refresh(link);
+}
+
+void picoquictest_sim_link_sched_refresh(picoquictest_sim_link_t* link)
+{
+    if (link->sched != NULL) {
+        picoquictest_sim_sched_update(link->sched, link->sched_slot,
+            (link->first_packet == NULL) ? UINT64_MAX : link->first_packet->arrival_time);
+    }
+}
+
 uint64_t picoquictest_sim_link_next_arrival(picoquictest_sim_link_t* link, uint64_t current_time)
 {
     picoquictest_sim_packet_t* packet = link->first_packet;
@@ -113,6 +278,7 @@ picoquictest_sim_packet_t* picoquictest_sim_link_dequeue(picoquictest_sim_link_t
         if (link->first_packet == NULL) {
             link->last_packet = NULL;
         }
+        picoquictest_sim_link_sched_refresh(link);
     } else {
         packet = NULL;
     }
@@ -244,6 +410,7 @@ void picoquictest_sim_link_submit(picoquictest_sim_link_t* link, picoquictest_si
             link->last_packet->next_packet = packet;
         }
         link->last_packet = packet;
+        picoquictest_sim_link_sched_refresh(link);
         return;
     }
     
@@ -281,7 +448,7 @@ void picoquictest_sim_link_submit(picoquictest_sim_link_t* link, picoquictest_si
         if (packet->length > link->path_mtu || picoquictest_sim_link_testloss(link->loss_mask) != 0 ||
             link->is_switched_off || picoquictest_sim_link_simloss(link, current_time)) {
             link->packets_dropped++;
-            free(packet);
+            picoquictest_sim_pool_release_packet(link->pool, packet);
         } else {
             link->packets_sent++;
             if (link->last_packet == NULL) {
@@ -298,12 +465,14 @@ void picoquictest_sim_link_submit(picoquictest_sim_link_t* link, picoquictest_si
             if (packet->arrival_time < link->resume_time) {
                 packet->arrival_time = link->resume_time;
             }
-
+            if (link->first_packet == packet) {
+                picoquictest_sim_link_sched_refresh(link);
+            }
         }
     } else {
         /* simulate congestion loss or random drop on queue full */
         link->packets_dropped++;
-        free(packet);
+        picoquictest_sim_pool_release_packet(link->pool, packet);
     }
 }
 
@@ -329,6 +498,7 @@ void picoquic_test_simlink_suspend(picoquictest_sim_link_t* link, uint64_t time_
             packet->arrival_time = time_end_of_interval;
             packet = packet->next_packet;
         }
+        picoquictest_sim_link_sched_refresh(link);
     }
     else {
         /* Reset the queue delay to the end of interval */
@@ -345,6 +515,7 @@ void picoquic_test_simlink_suspend(picoquictest_sim_link_t* link, uint64_t time_
             picoquictest_sim_link_submit(link, packet, time_end_of_interval);
             packet = next_packet;
         }
+        picoquictest_sim_link_sched_refresh(link);
     }
 }
 
@@ -424,6 +595,124 @@ int sim_link_test()
     return ret;
 }
 
+/* Verify that the scheduler finds the same next slot as a linear scan,
+ * and that a link using a pool and a scheduler delivers the same packets
+ * as a regular link.
+ */
+static int sim_link_sched_check(picoquictest_sim_sched_t* sched, uint64_t* expected)
+{
+    int ret = 0;
+    size_t slot = SIZE_MAX;
+    size_t expected_slot = 0;
+    uint64_t wake_time = picoquictest_sim_sched_next(sched, &slot);
+
+    for (size_t i = 1; i < sched->nb_slots; i++) {
+        if (expected[i] < expected[expected_slot]) {
+            expected_slot = i;
+        }
+    }
+    if (wake_time != expected[expected_slot] || slot != expected_slot) {
+        DBG_PRINTF("Sched next: slot %zu, time %" PRIu64 ", expected slot %zu, time %" PRIu64,
+            slot, wake_time, expected_slot, expected[expected_slot]);
+        ret = -1;
+    }
+    return ret;
+}
+
+int sim_link_sched_test()
+{
+    int ret = 0;
+    picoquictest_sim_sched_t sched;
+    uint64_t expected[37];
+    uint64_t random_ctx = 0x5c4ed01e5c4ed01eull;
+    const size_t nb_slots = sizeof(expected) / sizeof(uint64_t);
+
+    if (picoquictest_sim_sched_init(&sched, nb_slots) != 0) {
+        ret = -1;
+    }
+    else {
+        for (size_t i = 0; i < nb_slots; i++) {
+            expected[i] = UINT64_MAX;
+        }
+        for (int i = 0; ret == 0 && i < 2000; i++) {
+            size_t slot = (size_t)picoquic_test_uniform_random(&random_ctx, nb_slots);
+            uint64_t wake_time = picoquic_test_uniform_random(&random_ctx, 64);
+
+            if (wake_time == 63) {
+                wake_time = UINT64_MAX;
+            }
+            expected[slot] = wake_time;
+            picoquictest_sim_sched_update(&sched, slot, wake_time);
+            ret = sim_link_sched_check(&sched, expected);
+        }
+        picoquictest_sim_sched_clear(&sched);
+    }
+
+    if (ret == 0) {
+        uint64_t loss_mask = 0x18;
+        picoquictest_sim_packet_pool_t pool = { NULL, 0, 4 };
+        picoquictest_sim_link_t* link = picoquictest_sim_link_create(0.01, 10000, &loss_mask, 0, 0);
+
+        if (link == NULL || picoquictest_sim_sched_init(&sched, 2) != 0) {
+            ret = -1;
+        }
+        else {
+            uint64_t current_time = 0;
+            uint64_t dequeued = 0;
+            size_t slot = 0;
+
+            link->pool = &pool;
+            picoquictest_sim_link_set_sched(link, &sched, 1);
+
+            for (int i = 0; ret == 0 && i < 16; i++) {
+                picoquictest_sim_packet_t* packet = picoquictest_sim_pool_get_packet(&pool);
+
+                if (packet == NULL) {
+                    ret = -1;
+                }
+                else {
+                    packet->length = sizeof(packet->bytes);
+                    picoquictest_sim_link_submit(link, packet, current_time);
+                    current_time += 250;
+                }
+            }
+
+            while (ret == 0) {
+                uint64_t wake_time = picoquictest_sim_sched_next(&sched, &slot);
+                picoquictest_sim_packet_t* packet;
+
+                if (wake_time != picoquictest_sim_link_next_arrival(link, UINT64_MAX) ||
+                    (wake_time != UINT64_MAX && slot != 1)) {
+                    DBG_PRINTF("Sched time %" PRIu64 " does not match link arrival", wake_time);
+                    ret = -1;
+                }
+                else if (wake_time == UINT64_MAX) {
+                    break;
+                }
+                else if ((packet = picoquictest_sim_link_dequeue(link, wake_time)) == NULL) {
+                    ret = -1;
+                }
+                else {
+                    dequeued++;
+                    picoquictest_sim_pool_release_packet(&pool, packet);
+                }
+            }
+
+            if (ret == 0 && (dequeued != 14 || pool.nb_free != 4)) {
+                DBG_PRINTF("Dequeued %" PRIu64 ", pool %zu", dequeued, pool.nb_free);
+                ret = -1;
+            }
+            picoquictest_sim_sched_clear(&sched);
+        }
+        if (link != NULL) {
+            picoquictest_sim_link_delete(link);
+        }
+        picoquictest_sim_pool_clear(&pool);
+    }
+
+    return ret;
+}
+
 void picoquic_set_test_address(struct sockaddr_in * addr, uint32_t addr_val, uint16_t port)
 {
     /* Init of the IP addresses */
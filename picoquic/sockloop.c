@@ -59,6 +59,9 @@
 
 #else /* Linux */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* Required for recvmmsg and sendmmsg */
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -78,6 +81,11 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#endif
 
 #ifndef __APPLE__
 #ifdef __LINUX__
@@ -88,6 +96,19 @@
 #endif
 
 #include <pthread.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <time.h>
+#endif
+#if defined(__APPLE__)
+#include <dlfcn.h>
+#endif
 
 #ifndef SOCKET_TYPE
 #define SOCKET_TYPE int
@@ -108,6 +129,7 @@
 #include "picoquic_internal.h"
 #include "picoquic_packet_loop.h"
 #include "picoquic_unified_log.h"
+#include "picoquic_lb.h"
 
 #if defined(_WINDOWS)
 #ifdef UDP_SEND_MSG_SIZE
@@ -123,6 +145,37 @@ static int udp_gso_available = 0;
 #endif
 #endif
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define PICOQUIC_PACKET_LOOP_MMSG
+#endif
+
+#if defined(__APPLE__) && !defined(PICOQUIC_NO_MSG_X)
+/* Batches use recvmsg_x and sendmsg_x on macOS and iOS */
+#define PICOQUIC_PACKET_LOOP_MMSG
+#define PICOQUIC_PACKET_LOOP_MSG_X
+#endif
+
+#if defined(__linux__)
+#define PICOQUIC_PACKET_LOOP_EPOLL
+#elif defined(EV_CLEAR)
+#define PICOQUIC_PACKET_LOOP_KQUEUE
+#endif
+#if defined(PICOQUIC_PACKET_LOOP_EPOLL) || defined(PICOQUIC_PACKET_LOOP_KQUEUE)
+#define PICOQUIC_PACKET_LOOP_POLL
+#endif
+
+#if defined(__linux__) && defined(SO_TXTIME) && defined(SCM_TXTIME)
+#define PICOQUIC_PACKET_LOOP_TXTIME
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define PICOQUIC_PACKET_LOOP_ZEROCOPY
+#endif
+
+#if defined(__linux__)
+#define PICOQUIC_WAKE_UP_EVENTFD
+#endif
+
 #ifdef _WINDOWS
 /* Test support for UDP coalescing */
 void picoquic_sockloop_win_coalescing_test(int * recv_coalesced, int * send_coalesced)
@@ -261,7 +314,7 @@ int picoquic_packet_set_windows_socket(int send_coalesced, int recv_coalesced, p
             s_ctx->recv_buffer_size = 0x10000;
         }
         else {
-            s_ctx->recv_buffer_size = PICOQUIC_MAX_PACKET_SIZE;
+            s_ctx->recv_buffer_size = PICOQUIC_MAX_JUMBO_PACKET_SIZE;
         }
         s_ctx->recv_buffer = (uint8_t*)malloc(s_ctx->recv_buffer_size);
         if (s_ctx->recv_buffer == NULL) {
@@ -342,6 +395,64 @@ void picoquic_packet_loop_close_socket(picoquic_socket_ctx_t* s_ctx)
 #endif
 }
 
+static int picoquic_packet_loop_set_reuse_port(picoquic_socket_ctx_t* s_ctx)
+{
+    int ret = 0;
+
+    if (s_ctx->reuse_port && s_ctx->port != 0) {
+#ifdef SO_REUSEPORT
+        int val = 1;
+        if ((ret = setsockopt(s_ctx->fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&val, sizeof(val))) != 0) {
+            DBG_PRINTF("Cannot set SO_REUSEPORT, err=%d", errno);
+        }
+#else
+        DBG_PRINTF("%s", "SO_REUSEPORT is not supported on this platform");
+        ret = -1;
+#endif
+    }
+    return ret;
+}
+
+/* Steering program for the SO_REUSEPORT group. The shard index is found in
+ * the second byte of the destination CID, which is at offset 2 in short
+ * header packets, and at offset 7 in long header packets. The program returns
+ * that byte modulo the number of shards. Long header packets with a CID
+ * shorter than 2 bytes get the value 0xFFFFFFFF, which is out of range, and
+ * causes the kernel to fall back to the default hash.
+ */
+static int picoquic_packet_loop_set_steering(picoquic_socket_ctx_t* s_ctx)
+{
+    int ret = 0;
+
+    if (s_ctx->reuse_port && s_ctx->port != 0 && s_ctx->reuseport_steering_shards > 0) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+            BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 2, 0),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2),
+            BPF_JUMP(BPF_JMP | BPF_JA, 3, 0, 0),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 5),
+            BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 2, 0, 3),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 7),
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)s_ctx->reuseport_steering_shards),
+            BPF_STMT(BPF_RET | BPF_A, 0),
+            BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF)
+        };
+        struct sock_fprog prog;
+
+        prog.len = (unsigned short)(sizeof(code) / sizeof(code[0]));
+        prog.filter = code;
+        if ((ret = setsockopt(s_ctx->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) != 0) {
+            DBG_PRINTF("Cannot attach the SO_REUSEPORT steering program, err=%d", errno);
+        }
+#else
+        /* Without steering, the kernel distributes the packets by hash of the 4-tuple. */
+        DBG_PRINTF("%s", "SO_REUSEPORT steering is not supported on this platform");
+#endif
+    }
+    return ret;
+}
+
 int picoquic_packet_loop_open_socket(int socket_buffer_size, int do_not_use_gso,
     picoquic_socket_ctx_t* s_ctx)
 {
@@ -362,7 +473,8 @@ int picoquic_packet_loop_open_socket(int socket_buffer_size, int do_not_use_gso,
 #endif
     }
     s_ctx->overlap.hEvent = WSA_INVALID_EVENT;
-    s_ctx->fd = WSASocket(s_ctx->af, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    s_ctx->fd = WSASocket(s_ctx->af, SOCK_DGRAM, IPPROTO_UDP, NULL, 0,
+        WSA_FLAG_OVERLAPPED | ((s_ctx->use_rio) ? WSA_FLAG_REGISTERED_IO : 0));
 #else
     s_ctx->fd = socket(s_ctx->af, SOCK_DGRAM, IPPROTO_UDP);
 #endif
@@ -371,7 +483,9 @@ int picoquic_packet_loop_open_socket(int socket_buffer_size, int do_not_use_gso,
         /* TODO: set option IPv6 only */
         picoquic_socket_set_ecn_options(s_ctx->fd, s_ctx->af, &recv_set, &send_set) != 0 ||
         picoquic_socket_set_pkt_info(s_ctx->fd, s_ctx->af) != 0 ||
+        picoquic_packet_loop_set_reuse_port(s_ctx) != 0 ||
         picoquic_bind_to_port(s_ctx->fd,s_ctx->af, s_ctx->port) != 0 ||
+        picoquic_packet_loop_set_steering(s_ctx) != 0 ||
         picoquic_get_local_address(s_ctx->fd, &local_address) != 0 ||
         picoquic_socket_set_pmtud_options(s_ctx->fd, s_ctx->af) != 0)
     {
@@ -418,9 +532,100 @@ int picoquic_packet_loop_open_socket(int socket_buffer_size, int do_not_use_gso,
             }
         }
 #ifdef _WINDOWS
-        if (ret == 0) {
+        if (ret == 0 && s_ctx->use_rio) {
+            /* Receive requests are posted by picoquic_packet_loop_rio, in
+             * buffers of recv_buffer_size bytes. Coalesced receive is only
+             * requested if these buffers can hold more than one packet. */
+            s_ctx->supports_udp_send_coalesced = send_coalesced;
+#ifdef UDP_RECV_MAX_COALESCED_SIZE
+            if (recv_coalesced && s_ctx->recv_buffer_size > PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
+                DWORD coalesced_size = (DWORD)s_ctx->recv_buffer_size;
+                if (setsockopt(s_ctx->fd, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, (char*)&coalesced_size,
+                    (int)sizeof(coalesced_size)) != 0) {
+                    DBG_PRINTF("Cannot set UDP_RECV_MAX_COALESCED_SIZE %d, returns %d",
+                        coalesced_size, GetLastError());
+                }
+                else {
+                    s_ctx->supports_udp_recv_coalesced = 1;
+                }
+            }
+#endif
+        }
+        else if (ret == 0) {
             ret = picoquic_packet_set_windows_socket(send_coalesced, recv_coalesced, s_ctx);
         }
+#elif defined(UDP_GRO)
+        if (ret == 0 && s_ctx->use_gro && !do_not_use_gso) {
+            /* Receive coalesced datagrams, if the loop provides buffers large
+             * enough. Failure is not fatal, the socket just receives datagrams
+             * one at a time. */
+            int gro_on = 1;
+            if (setsockopt(s_ctx->fd, SOL_UDP, UDP_GRO, &gro_on, sizeof(gro_on)) == 0) {
+                s_ctx->supports_udp_recv_coalesced = 1;
+            }
+        }
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_TXTIME
+        if (ret == 0 && s_ctx->use_txtime) {
+            /* Departure times are expressed in CLOCK_MONOTONIC. Failure is not
+             * fatal, the loop will just not prepare packets in advance. */
+            struct sock_txtime txtime_config = { 0 };
+            txtime_config.clockid = CLOCK_MONOTONIC;
+            if (setsockopt(s_ctx->fd, SOL_SOCKET, SO_TXTIME, &txtime_config, sizeof(txtime_config)) != 0) {
+                DBG_PRINTF("Cannot set SO_TXTIME, err=%d", errno);
+                s_ctx->use_txtime = 0;
+            }
+        }
+#else
+        s_ctx->use_txtime = 0;
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+        if (ret == 0 && s_ctx->use_zerocopy) {
+            int zerocopy_on = 1;
+            if (setsockopt(s_ctx->fd, SOL_SOCKET, SO_ZEROCOPY, &zerocopy_on, sizeof(zerocopy_on)) != 0) {
+                DBG_PRINTF("Cannot set SO_ZEROCOPY, err=%d", errno);
+                s_ctx->use_zerocopy = 0;
+            }
+        }
+#else
+        s_ctx->use_zerocopy = 0;
+#endif
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+        if (ret == 0 && s_ctx->busy_poll_usec > 0) {
+            /* Failure is not fatal, the loop then spins without polling the device */
+            int busy_poll = s_ctx->busy_poll_usec;
+            if (setsockopt(s_ctx->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) != 0) {
+                DBG_PRINTF("Cannot set SO_BUSY_POLL, err=%d", errno);
+                s_ctx->busy_poll_usec = 0;
+            }
+#ifdef SO_PREFER_BUSY_POLL
+            else {
+                int prefer_busy_poll = 1;
+                (void)setsockopt(s_ctx->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer_busy_poll, sizeof(prefer_busy_poll));
+            }
+#endif
+        }
+#else
+        s_ctx->busy_poll_usec = 0;
+#endif
+#ifndef _WINDOWS
+        if (ret == 0 && s_ctx->use_rx_timestamps) {
+            /* Failure is not fatal, the packets are then timestamped
+             * when the loop processes them. */
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+            int ts_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+            if (setsockopt(s_ctx->fd, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)) != 0)
+#elif defined(SO_TIMESTAMP)
+            int ts_on = 1;
+            if (setsockopt(s_ctx->fd, SOL_SOCKET, SO_TIMESTAMP, &ts_on, sizeof(ts_on)) != 0)
+#endif
+            {
+                DBG_PRINTF("Cannot enable receive timestamps, err=%d", errno);
+                s_ctx->use_rx_timestamps = 0;
+            }
+        }
+#else
+        s_ctx->use_rx_timestamps = 0;
 #endif
     }
 
@@ -573,28 +778,23 @@ int picoquic_packet_loop_wait(picoquic_socket_ctx_t* s_ctx,
     return bytes_recv;
 }
 #else 
-int picoquic_packet_loop_select(picoquic_socket_ctx_t* s_ctx,
+/* Wait until one of the sockets is readable, or the wake up pipe is
+ * signalled, or the delay expires. Returns -1 on error, 0 if no socket
+ * is ready, 1 if data can be read from the socket at *socket_rank.
+ */
+static int picoquic_packet_loop_wait_readable(picoquic_socket_ctx_t* s_ctx,
     int nb_sockets,
-    struct sockaddr_storage* addr_from,
-    struct sockaddr_storage* addr_dest,
-    int* dest_if,
-    unsigned char * received_ecn,
-    uint8_t* buffer, int buffer_max,
     int64_t delta_t,
-    int * is_wake_up_event,
-    picoquic_network_thread_ctx_t * thread_ctx,
-    int * socket_rank)
+    int* is_wake_up_event,
+    picoquic_network_thread_ctx_t* thread_ctx,
+    int* socket_rank)
 {
     fd_set readfds;
     struct timeval tv;
     int ret_select = 0;
-    int bytes_recv = 0;
+    int ret = 0;
     int sockmax = 0;
 
-    if (received_ecn != NULL) {
-        *received_ecn = 0;
-    }
-
     FD_ZERO(&readfds);
 
     for (int i = 0; i < nb_sockets; i++) {
@@ -628,7 +828,7 @@ int picoquic_packet_loop_select(picoquic_socket_ctx_t* s_ctx,
     ret_select = select(sockmax + 1, &readfds, NULL, NULL, &tv);
 
     if (ret_select < 0) {
-        bytes_recv = -1;
+        ret = -1;
         DBG_PRINTF("Error: select returns %d\n", ret_select);
     } else if (ret_select > 0) {
         /* Check if the 'wake up' pipe is full. If it is, read the data on it,
@@ -638,7 +838,7 @@ int picoquic_packet_loop_select(picoquic_socket_ctx_t* s_ctx,
             uint8_t eventbuf[8];
             int pipe_recv;
             if ((pipe_recv = read(thread_ctx->wake_up_pipe_fd[0], eventbuf, sizeof(eventbuf))) <= 0) {
-                bytes_recv = -1;
+                ret = -1;
                 DBG_PRINTF("Error: read pipe returns %d\n", (pipe_recv == 0)?EPIPE:errno);
             }
             else {
@@ -650,147 +850,1437 @@ int picoquic_packet_loop_select(picoquic_socket_ctx_t* s_ctx,
             for (int i = 0; i < nb_sockets; i++) {
                 if (FD_ISSET(s_ctx[i].fd, &readfds)) {
                     *socket_rank = i;
-                    bytes_recv = picoquic_recvmsg(s_ctx[i].fd, addr_from,
-                        addr_dest, dest_if, received_ecn,
-                        buffer, buffer_max);
-
-                    if (bytes_recv <= 0) {
-                        DBG_PRINTF("Could not receive packet on UDP socket[%d]= %d!\n",
-                            i, (int)s_ctx[i].fd);
-                        break;
-                    }
-                    else {
-                        /* Document incoming port */
-                        if (addr_dest->ss_family == AF_INET6) {
-                            ((struct sockaddr_in6*)addr_dest)->sin6_port = s_ctx[i].n_port;
-                        }
-                        else if (addr_dest->ss_family == AF_INET) {
-                            ((struct sockaddr_in*)addr_dest)->sin_port = s_ctx[i].n_port;
-                        }
-                        break;
-                    }
+                    ret = 1;
+                    break;
                 }
             }
         }
     }
 
-    return bytes_recv;
+    return ret;
 }
-#endif
 
-static int monitor_system_call_duration(packet_loop_system_call_duration_t* sc_duration, uint64_t current_time, uint64_t previous_time)
+static void picoquic_packet_loop_set_dest_port(picoquic_socket_ctx_t* s_ctx, struct sockaddr_storage* addr_dest)
 {
-    uint64_t duration = current_time - previous_time;
-    int64_t dev = sc_duration->scd_smoothed - duration;
-    int shall_notify = 0;
+    /* Document incoming port */
+    if (addr_dest->ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)addr_dest)->sin6_port = s_ctx->n_port;
+    }
+    else if (addr_dest->ss_family == AF_INET) {
+        ((struct sockaddr_in*)addr_dest)->sin_port = s_ctx->n_port;
+    }
+}
 
-    if (duration > sc_duration->scd_max) {
-        shall_notify = 1;
-        sc_duration->scd_max = duration;
+int picoquic_packet_loop_select(picoquic_socket_ctx_t* s_ctx,
+    int nb_sockets,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char * received_ecn,
+    uint8_t* buffer, int buffer_max,
+    int64_t delta_t,
+    int * is_wake_up_event,
+    picoquic_network_thread_ctx_t * thread_ctx,
+    int * socket_rank)
+{
+    int bytes_recv = 0;
+
+    if (received_ecn != NULL) {
+        *received_ecn = 0;
     }
-    else if (duration != sc_duration->scd_last) {
-        int64_t delta_d = sc_duration->scd_last - duration;
 
-        if (delta_d > 1000 || delta_d < -1000 || delta_d < (int64_t)sc_duration->scd_last) {
-            shall_notify = 1;
+    bytes_recv = picoquic_packet_loop_wait_readable(s_ctx, nb_sockets, delta_t,
+        is_wake_up_event, thread_ctx, socket_rank);
+
+    if (bytes_recv > 0) {
+        int i = *socket_rank;
+        bytes_recv = picoquic_recvmsg_ex(s_ctx[i].fd, addr_from,
+            addr_dest, dest_if, received_ecn,
+            buffer, buffer_max, 0, &s_ctx[i].udp_coalesced_size, &s_ctx[i].receive_time);
+
+        if (bytes_recv <= 0) {
+            DBG_PRINTF("Could not receive packet on UDP socket[%d]= %d!\n",
+                i, (int)s_ctx[i].fd);
+        }
+        else {
+            picoquic_packet_loop_set_dest_port(&s_ctx[i], addr_dest);
         }
-        sc_duration->scd_last = duration;
     }
 
-    sc_duration->scd_smoothed = (duration + 15 * sc_duration->scd_smoothed) / 16;
-    if (dev < 0) {
-        dev = -dev;
-    }
-    sc_duration->scd_dev = (7 * sc_duration->scd_dev + dev) / 8;
+    return bytes_recv;
+}
 
-    return shall_notify;
+#ifdef PICOQUIC_PACKET_LOOP_POLL
+/* Readiness notification using epoll on Linux, or kqueue on BSD and macOS.
+ * The sockets and the wake up pipe are registered once, when the loop starts,
+ * instead of rebuilding an fd_set on every call. The sockets are registered
+ * in edge triggered mode: a notification marks the socket as readable, and
+ * the mark is only cleared when a read returns EAGAIN. While some socket is
+ * marked, the wait uses a zero timeout. Marked sockets are served in round
+ * robin order. The wake up pipe is level triggered, so that a closed pipe
+ * keeps being reported until the loop exits.
+ */
+#define PICOQUIC_PACKET_LOOP_POLL_EVENTS 16
+#define PICOQUIC_PACKET_LOOP_POLL_WAKE_UP 0xFFFFFFFFu
+
+typedef struct st_picoquic_packet_loop_poll_t {
+    int poll_fd;
+    int nb_sockets;
+    int next_rank;
+    uint8_t* is_readable;
+} picoquic_packet_loop_poll_t;
+
+static void picoquic_packet_loop_poll_delete(picoquic_packet_loop_poll_t* poll_ctx)
+{
+    if (poll_ctx != NULL) {
+        if (poll_ctx->poll_fd >= 0) {
+            close(poll_ctx->poll_fd);
+        }
+        if (poll_ctx->is_readable != NULL) {
+            free(poll_ctx->is_readable);
+        }
+        free(poll_ctx);
+    }
 }
 
+static int picoquic_packet_loop_poll_add(picoquic_packet_loop_poll_t* poll_ctx, int fd, uint32_t tag, int edge_triggered)
+{
+    int ret;
+#ifdef PICOQUIC_PACKET_LOOP_EPOLL
+    struct epoll_event ev;
 
-#ifdef _WINDOWS
-    DWORD WINAPI picoquic_packet_loop_v3(LPVOID v_ctx)
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (edge_triggered) {
+        ev.events |= EPOLLET;
+    }
+    ev.data.u32 = tag;
+    ret = epoll_ctl(poll_ctx->poll_fd, EPOLL_CTL_ADD, fd, &ev);
 #else
-void* picoquic_packet_loop_v3(void* v_ctx)
+    struct kevent ev;
+
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD | ((edge_triggered) ? EV_CLEAR : 0), 0, 0,
+        (void*)(uintptr_t)tag);
+    ret = kevent(poll_ctx->poll_fd, &ev, 1, NULL, 0, NULL);
 #endif
+    if (ret != 0) {
+        DBG_PRINTF("Cannot register socket %d for readiness, err=%d", fd, errno);
+    }
+    return ret;
+}
+
+static picoquic_packet_loop_poll_t* picoquic_packet_loop_poll_create(picoquic_socket_ctx_t* s_ctx,
+    int nb_sockets, picoquic_network_thread_ctx_t* thread_ctx)
 {
-    picoquic_network_thread_ctx_t* thread_ctx = (picoquic_network_thread_ctx_t*)v_ctx;
-    picoquic_quic_t* quic = thread_ctx->quic;
-    picoquic_packet_loop_param_t* param = thread_ctx->param;
-    picoquic_packet_loop_cb_fn loop_callback = thread_ctx->loop_callback;
-    void* loop_callback_ctx = thread_ctx->loop_callback_ctx;
     int ret = 0;
-    uint64_t current_time = picoquic_get_quic_time(quic);
-    int64_t delay_max = 10000000;
-    struct sockaddr_storage addr_from;
-    struct sockaddr_storage addr_to;
-    int if_index_to;
-#ifndef _WINDOWS
-    uint8_t buffer[1536];
+    picoquic_packet_loop_poll_t* poll_ctx = (picoquic_packet_loop_poll_t*)malloc(sizeof(picoquic_packet_loop_poll_t));
+
+    if (poll_ctx != NULL) {
+        memset(poll_ctx, 0, sizeof(picoquic_packet_loop_poll_t));
+        poll_ctx->nb_sockets = nb_sockets;
+#ifdef PICOQUIC_PACKET_LOOP_EPOLL
+        poll_ctx->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+        poll_ctx->poll_fd = kqueue();
 #endif
-    uint8_t* send_buffer = NULL;
-    size_t send_length = 0;
-    size_t send_msg_size = 0;
-    size_t send_buffer_size = param->socket_buffer_size;
-    size_t* send_msg_ptr = NULL;
-    int bytes_recv;
-    picoquic_connection_id_t log_cid;
-    picoquic_socket_ctx_t s_ctx[4];
-    int nb_sockets = 0;
-    int nb_sockets_available = 0;
-    picoquic_cnx_t* last_cnx = NULL;
-    int loop_immediate = 0;
-    unsigned int nb_loop_immediate = 0;
-    picoquic_packet_loop_options_t options = { 0 };
-    packet_loop_system_call_duration_t sc_duration = { 0 };
+        if (poll_ctx->poll_fd < 0) {
+            DBG_PRINTF("Cannot create the readiness queue, err=%d", errno);
+            ret = -1;
+        }
+        else if ((poll_ctx->is_readable = (uint8_t*)malloc(nb_sockets)) == NULL) {
+            ret = -1;
+        }
+        else {
+            /* Mark all sockets as readable, in case packets were queued before registration */
+            memset(poll_ctx->is_readable, 1, nb_sockets);
+            for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+                ret = picoquic_packet_loop_poll_add(poll_ctx, (int)s_ctx[i].fd, (uint32_t)i, 1);
+            }
+            if (ret == 0 && thread_ctx->wake_up_defined) {
+                ret = picoquic_packet_loop_poll_add(poll_ctx, thread_ctx->wake_up_pipe_fd[0],
+                    PICOQUIC_PACKET_LOOP_POLL_WAKE_UP, 0);
+            }
+        }
+        if (ret != 0) {
+            picoquic_packet_loop_poll_delete(poll_ctx);
+            poll_ctx = NULL;
+        }
+    }
+    return poll_ctx;
+}
 
-    int is_wake_up_event;
-#ifdef _WINDOWS
-    WSADATA wsaData = { 0 };
-    (void)WSA_START(MAKEWORD(2, 2), &wsaData);
+static void picoquic_packet_loop_poll_clear(picoquic_packet_loop_poll_t* poll_ctx, int socket_rank)
+{
+    poll_ctx->is_readable[socket_rank] = 0;
+}
+
+/* Same contract as picoquic_packet_loop_wait_readable: returns -1 on error,
+ * 0 if no socket is ready, 1 if the socket at *socket_rank may be read. Only
+ * the first nb_sockets sockets are considered. */
+static int picoquic_packet_loop_poll_wait(picoquic_packet_loop_poll_t* poll_ctx,
+    int nb_sockets,
+    int64_t delta_t,
+    int* is_wake_up_event,
+    picoquic_network_thread_ctx_t* thread_ctx,
+    int* socket_rank)
+{
+    int ret = 0;
+    int nb_events;
+    int is_pending = 0;
+    int wake_up_received = 0;
+#ifdef PICOQUIC_PACKET_LOOP_EPOLL
+    struct epoll_event events[PICOQUIC_PACKET_LOOP_POLL_EVENTS];
+    int timeout_ms;
+#else
+    struct kevent events[PICOQUIC_PACKET_LOOP_POLL_EVENTS];
+    struct timespec ts;
 #endif
 
-    if (thread_ctx->thread_name != NULL) {
-        thread_ctx->thread_setname_fn(thread_ctx->thread_name);
+    *is_wake_up_event = 0;
+    for (int i = 0; i < nb_sockets && !is_pending; i++) {
+        is_pending = poll_ctx->is_readable[i];
     }
-
-    if (send_buffer_size == 0) {
-        send_buffer_size = 0xffff;
+    if (is_pending || delta_t <= 0) {
+        delta_t = 0;
     }
-
-    memset(s_ctx, 0, sizeof(s_ctx));
-    if ((nb_sockets = picoquic_packet_loop_open_sockets(param->local_port,
-        param->local_af, param->socket_buffer_size,
-        param->extra_socket_required, param->do_not_use_gso, s_ctx)) <= 0) {
-        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    else if (delta_t > 10000000) {
+        delta_t = 10000000;
     }
-    else if (loop_callback != NULL) {
-        struct sockaddr_storage l_addr;
-        ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+#ifdef PICOQUIC_PACKET_LOOP_EPOLL
+    /* epoll_wait has a millisecond granularity. Rounding down means
+     * that the last millisecond before a timer is spent polling, but
+     * timers are never served late. */
+    timeout_ms = (int)(delta_t / 1000);
+    nb_events = epoll_wait(poll_ctx->poll_fd, events, PICOQUIC_PACKET_LOOP_POLL_EVENTS, timeout_ms);
+#else
+    ts.tv_sec = (time_t)(delta_t / 1000000);
+    ts.tv_nsec = (long)((delta_t % 1000000) * 1000);
+    nb_events = kevent(poll_ctx->poll_fd, NULL, 0, events, PICOQUIC_PACKET_LOOP_POLL_EVENTS, &ts);
+#endif
 
-        if (picoquic_store_loopback_addr(&l_addr, s_ctx[0].af, s_ctx[0].port) == 0) {
-            ret = loop_callback(quic, picoquic_packet_loop_port_update, loop_callback_ctx, &l_addr);
+    if (nb_events < 0) {
+        if (errno != EINTR) {
+            DBG_PRINTF("Error: readiness wait returns %d\n", errno);
+            ret = -1;
         }
-        if (ret == 0 && options.provide_alt_port) {
-            int alt_sock = (nb_sockets > 2 && param->local_af == 0) ? 2 : 1;
-            uint16_t alt_port = s_ctx[alt_sock].port;
-            ret = loop_callback(quic, picoquic_packet_loop_alt_port, loop_callback_ctx, &alt_port);
+    }
+    else {
+        for (int i = 0; i < nb_events; i++) {
+#ifdef PICOQUIC_PACKET_LOOP_EPOLL
+            uint32_t tag = events[i].data.u32;
+#else
+            uint32_t tag = (uint32_t)(uintptr_t)events[i].udata;
+#endif
+            if (tag == PICOQUIC_PACKET_LOOP_POLL_WAKE_UP) {
+                wake_up_received = 1;
+            }
+            else if (tag < (uint32_t)poll_ctx->nb_sockets) {
+                /* Errors are also flagged as readable, so they are reported by the next read. */
+                poll_ctx->is_readable[tag] = 1;
+            }
         }
     }
 
-    if (ret == 0) {
-        nb_sockets_available = nb_sockets;
-
-        if (udp_gso_available && !param->do_not_use_gso) {
-            send_buffer_size = 0xFFFF;
-            send_msg_ptr = &send_msg_size;
-        }
-        send_buffer = malloc(send_buffer_size);
-        if (send_buffer == NULL) {
+    if (ret == 0 && wake_up_received) {
+        /* Something was written on the "wakeup" pipe. Read it. */
+        uint8_t eventbuf[8];
+        int pipe_recv;
+        if ((pipe_recv = read(thread_ctx->wake_up_pipe_fd[0], eventbuf, sizeof(eventbuf))) <= 0) {
             ret = -1;
+            DBG_PRINTF("Error: read pipe returns %d\n", (pipe_recv == 0) ? EPIPE : errno);
+        }
+        else {
+            *is_wake_up_event = 1;
         }
     }
+    else if (ret == 0) {
+        for (int k = 0; k < nb_sockets; k++) {
+            int i = (poll_ctx->next_rank + k) % nb_sockets;
+            if (poll_ctx->is_readable[i]) {
+                *socket_rank = i;
+                poll_ctx->next_rank = (i + 1) % nb_sockets;
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Variant of picoquic_packet_loop_select used with the readiness queue.
+ * The socket is read without blocking, and marked as drained when the
+ * read returns EAGAIN. */
+static int picoquic_packet_loop_poll_recv(picoquic_packet_loop_poll_t* poll_ctx,
+    picoquic_socket_ctx_t* s_ctx,
+    int nb_sockets,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max,
+    int64_t delta_t,
+    int* is_wake_up_event,
+    picoquic_network_thread_ctx_t* thread_ctx,
+    int* socket_rank)
+{
+    int bytes_recv = 0;
+
+    if (received_ecn != NULL) {
+        *received_ecn = 0;
+    }
+
+    bytes_recv = picoquic_packet_loop_poll_wait(poll_ctx, nb_sockets, delta_t,
+        is_wake_up_event, thread_ctx, socket_rank);
+
+    if (bytes_recv > 0) {
+        int i = *socket_rank;
+        bytes_recv = picoquic_recvmsg_ex(s_ctx[i].fd, addr_from,
+            addr_dest, dest_if, received_ecn,
+            buffer, buffer_max, MSG_DONTWAIT, &s_ctx[i].udp_coalesced_size, &s_ctx[i].receive_time);
+
+        if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (errno != EINTR) {
+                picoquic_packet_loop_poll_clear(poll_ctx, i);
+            }
+            bytes_recv = 0;
+        }
+        else if (bytes_recv <= 0) {
+            DBG_PRINTF("Could not receive packet on UDP socket[%d]= %d!\n",
+                i, (int)s_ctx[i].fd);
+        }
+        else {
+            picoquic_packet_loop_set_dest_port(&s_ctx[i], addr_dest);
+        }
+    }
+
+    return bytes_recv;
+}
+#endif
+#endif
+
+/* When the stack has nothing to send at *send_time, check whether the next
+ * wake time falls within the SO_TXTIME horizon. If it does, move *send_time
+ * to that wake time and return 1: the caller prepares the packet now, and
+ * the kernel holds it until its departure time. */
+static int picoquic_packet_loop_txtime_advance(picoquic_quic_t* quic, uint64_t current_time,
+    uint64_t txtime_horizon, uint64_t* send_time)
+{
+    int ret = 0;
+
+    if (txtime_horizon > 0) {
+        uint64_t next_time = picoquic_get_next_wake_time(quic, *send_time);
+
+        if (next_time > *send_time && next_time <= current_time + txtime_horizon) {
+            *send_time = next_time;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+#ifndef _WINDOWS
+/* Departure time of a packet prepared for send_time, in CLOCK_MONOTONIC
+ * nanoseconds as expected by SCM_TXTIME, or 0 if the packet is due now. */
+static uint64_t picoquic_packet_loop_txtime(uint64_t send_time)
+{
+    uint64_t txtime_ns = 0;
+#ifdef PICOQUIC_PACKET_LOOP_TXTIME
+    uint64_t now = picoquic_current_time();
+
+    if (send_time > now) {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+            txtime_ns = ((uint64_t)ts.tv_sec) * 1000000000ull + (uint64_t)ts.tv_nsec +
+                (send_time - now) * 1000ull;
+        }
+    }
+#else
+    (void)send_time;
+#endif
+    return txtime_ns;
+}
+#endif
+
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+/* Pool of send buffers for MSG_ZEROCOPY. The kernel keeps references to
+ * the pages of a buffer sent with MSG_ZEROCOPY until the data has left
+ * the host, so the buffer cannot be reused until then. Each socket
+ * numbers its zero copy sends from 0, and the kernel signals completions
+ * as ranges of these numbers, on the socket error queue.
+ */
+typedef struct st_picoquic_packet_loop_zc_buffer_t {
+    uint8_t* buffer;
+    int in_flight;
+    int socket_rank;
+    uint32_t zc_id;
+} picoquic_packet_loop_zc_buffer_t;
+
+typedef struct st_picoquic_packet_loop_zc_pool_t {
+    int nb_buffers;
+    int nb_in_flight;
+    size_t buffer_size;
+    uint8_t* memory;
+    picoquic_packet_loop_zc_buffer_t* buffers;
+} picoquic_packet_loop_zc_pool_t;
+
+static void picoquic_packet_loop_zc_delete(picoquic_packet_loop_zc_pool_t* pool)
+{
+    if (pool != NULL) {
+        if (pool->memory != NULL) {
+            free(pool->memory);
+        }
+        if (pool->buffers != NULL) {
+            free(pool->buffers);
+        }
+        free(pool);
+    }
+}
+
+static picoquic_packet_loop_zc_pool_t* picoquic_packet_loop_zc_create(int nb_buffers, size_t buffer_size)
+{
+    picoquic_packet_loop_zc_pool_t* pool = (picoquic_packet_loop_zc_pool_t*)malloc(sizeof(picoquic_packet_loop_zc_pool_t));
+
+    if (pool != NULL) {
+        memset(pool, 0, sizeof(picoquic_packet_loop_zc_pool_t));
+        pool->nb_buffers = nb_buffers;
+        pool->buffer_size = buffer_size;
+        if ((pool->memory = (uint8_t*)malloc(buffer_size * nb_buffers)) == NULL ||
+            (pool->buffers = (picoquic_packet_loop_zc_buffer_t*)malloc(
+                sizeof(picoquic_packet_loop_zc_buffer_t) * nb_buffers)) == NULL) {
+            picoquic_packet_loop_zc_delete(pool);
+            pool = NULL;
+        }
+        else {
+            memset(pool->buffers, 0, sizeof(picoquic_packet_loop_zc_buffer_t) * nb_buffers);
+            for (int i = 0; i < nb_buffers; i++) {
+                pool->buffers[i].buffer = pool->memory + buffer_size * i;
+            }
+        }
+    }
+    return pool;
+}
+
+/* Release the buffers sent on the socket with numbers in [lo, hi]. The
+ * numbers are 32 bit counters, and may wrap around. */
+static void picoquic_packet_loop_zc_release(picoquic_packet_loop_zc_pool_t* pool, int socket_rank, uint32_t lo, uint32_t hi)
+{
+    for (int i = 0; i < pool->nb_buffers; i++) {
+        picoquic_packet_loop_zc_buffer_t* zc = &pool->buffers[i];
+        if (zc->in_flight && zc->socket_rank == socket_rank &&
+            (uint32_t)(zc->zc_id - lo) <= (uint32_t)(hi - lo)) {
+            zc->in_flight = 0;
+            pool->nb_in_flight--;
+        }
+    }
+}
+
+/* Read the completion notifications queued on the sockets error queues */
+static void picoquic_packet_loop_zc_reclaim(picoquic_packet_loop_zc_pool_t* pool, picoquic_socket_ctx_t* s_ctx, int nb_sockets)
+{
+    for (int i = 0; pool->nb_in_flight > 0 && i < nb_sockets; i++) {
+        for (;;) {
+            struct msghdr msg;
+            char control[128];
+            struct cmsghdr* cmsg;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(s_ctx[i].fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                break;
+            }
+            for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                    (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                    struct sock_extended_err serr;
+                    memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+                    if (serr.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                        picoquic_packet_loop_zc_release(pool, i, serr.ee_info, serr.ee_data);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Return the index of a free buffer, or -1 if all buffers are in flight */
+static int picoquic_packet_loop_zc_get(picoquic_packet_loop_zc_pool_t* pool, picoquic_socket_ctx_t* s_ctx, int nb_sockets)
+{
+    int zc_index = -1;
+
+    if (pool->nb_in_flight >= pool->nb_buffers) {
+        /* Only read the error queues when the pool is exhausted, since the
+         * kernel coalesces consecutive notifications in a single message. */
+        picoquic_packet_loop_zc_reclaim(pool, s_ctx, nb_sockets);
+    }
+    if (pool->nb_in_flight < pool->nb_buffers) {
+        for (int i = 0; i < pool->nb_buffers; i++) {
+            if (!pool->buffers[i].in_flight) {
+                zc_index = i;
+                break;
+            }
+        }
+    }
+    return zc_index;
+}
+
+/* Mark the buffer as in flight after a successful MSG_ZEROCOPY send */
+static void picoquic_packet_loop_zc_sent(picoquic_packet_loop_zc_pool_t* pool, int zc_index,
+    picoquic_socket_ctx_t* s_ctx, int nb_sockets, SOCKET_TYPE send_socket)
+{
+    for (int i = 0; i < nb_sockets; i++) {
+        if (s_ctx[i].fd == send_socket) {
+            pool->buffers[zc_index].in_flight = 1;
+            pool->buffers[zc_index].socket_rank = i;
+            pool->buffers[zc_index].zc_id = s_ctx[i].zerocopy_next_id++;
+            pool->nb_in_flight++;
+            break;
+        }
+    }
+}
+#endif
+
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+#ifdef PICOQUIC_PACKET_LOOP_MSG_X
+/* Apple platforms do not provide recvmmsg and sendmmsg, but the kernel has
+ * the equivalent calls recvmsg_x and sendmsg_x. They are not part of the
+ * public SDK, so they are located at run time with dlsym. If they are not
+ * found, or if the kernel rejects a call as unsupported, e.g., because
+ * sendmsg_x does not accept the destination address or the control
+ * messages, the loop falls back to one recvmsg or sendmsg per datagram.
+ * The batch code is the same as on Linux, through the emulated mmsghdr.
+ */
+struct msghdr_x {
+    void* msg_name;
+    socklen_t msg_namelen;
+    struct iovec* msg_iov;
+    int msg_iovlen;
+    void* msg_control;
+    socklen_t msg_controllen;
+    int msg_flags;
+    size_t msg_datalen;
+};
+
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+typedef ssize_t (*picoquic_msg_x_fn)(int s, const struct msghdr_x* msgp, u_int cnt, int flags);
+
+static picoquic_msg_x_fn picoquic_recvmsg_x_fn = NULL;
+static picoquic_msg_x_fn picoquic_sendmsg_x_fn = NULL;
+static volatile int picoquic_msg_x_resolved = 0;
+static volatile int picoquic_recvmsg_x_disabled = 0;
+static volatile int picoquic_sendmsg_x_disabled = 0;
+
+static void picoquic_msg_x_resolve(void)
+{
+    if (!picoquic_msg_x_resolved) {
+        picoquic_recvmsg_x_fn = (picoquic_msg_x_fn)dlsym(RTLD_DEFAULT, "recvmsg_x");
+        picoquic_sendmsg_x_fn = (picoquic_msg_x_fn)dlsym(RTLD_DEFAULT, "sendmsg_x");
+        picoquic_msg_x_resolved = 1;
+    }
+}
+
+static int picoquic_msg_x_is_unsupported(int err)
+{
+    return (err == ENOSYS || err == EOPNOTSUPP || err == EINVAL ||
+        err == ENOTCONN || err == EDESTADDRREQ || err == EISCONN);
+}
+
+static void picoquic_msg_x_from_mmsg(struct msghdr_x* msgs_x, struct mmsghdr* msgs, unsigned int vlen)
+{
+    for (unsigned int i = 0; i < vlen; i++) {
+        msgs_x[i].msg_name = msgs[i].msg_hdr.msg_name;
+        msgs_x[i].msg_namelen = msgs[i].msg_hdr.msg_namelen;
+        msgs_x[i].msg_iov = msgs[i].msg_hdr.msg_iov;
+        msgs_x[i].msg_iovlen = (int)msgs[i].msg_hdr.msg_iovlen;
+        msgs_x[i].msg_control = msgs[i].msg_hdr.msg_control;
+        msgs_x[i].msg_controllen = msgs[i].msg_hdr.msg_controllen;
+        msgs_x[i].msg_flags = 0;
+        msgs_x[i].msg_datalen = 0;
+    }
+}
+
+static int picoquic_recvmmsg(int fd, struct mmsghdr* msgs, unsigned int vlen, int flags, void* timeout)
+{
+    int nb_msg = -1;
+    int is_done = 0;
+
+    (void)timeout;
+    picoquic_msg_x_resolve();
+    if (vlen > PICOQUIC_PACKET_LOOP_BATCH_MAX) {
+        vlen = PICOQUIC_PACKET_LOOP_BATCH_MAX;
+    }
+    if (picoquic_recvmsg_x_fn != NULL && !picoquic_recvmsg_x_disabled) {
+        struct msghdr_x msgs_x[PICOQUIC_PACKET_LOOP_BATCH_MAX];
+
+        picoquic_msg_x_from_mmsg(msgs_x, msgs, vlen);
+        if ((nb_msg = (int)picoquic_recvmsg_x_fn(fd, msgs_x, vlen, flags)) >= 0) {
+            for (int i = 0; i < nb_msg; i++) {
+                msgs[i].msg_hdr.msg_namelen = msgs_x[i].msg_namelen;
+                msgs[i].msg_hdr.msg_controllen = msgs_x[i].msg_controllen;
+                msgs[i].msg_hdr.msg_flags = msgs_x[i].msg_flags;
+                msgs[i].msg_len = (unsigned int)msgs_x[i].msg_datalen;
+            }
+            is_done = 1;
+        }
+        else if (picoquic_msg_x_is_unsupported(errno)) {
+            DBG_PRINTF("recvmsg_x not supported, err= %d, using recvmsg", errno);
+            picoquic_recvmsg_x_disabled = 1;
+        }
+        else {
+            is_done = 1;
+        }
+    }
+    if (!is_done) {
+        nb_msg = 0;
+        while (nb_msg < (int)vlen) {
+            ssize_t bytes_recv = recvmsg(fd, &msgs[nb_msg].msg_hdr, flags);
+            if (bytes_recv < 0) {
+                if (nb_msg == 0) {
+                    nb_msg = -1;
+                }
+                break;
+            }
+            msgs[nb_msg].msg_len = (unsigned int)bytes_recv;
+            nb_msg++;
+        }
+    }
+    return nb_msg;
+}
+
+static int picoquic_sendmmsg(int fd, struct mmsghdr* msgs, unsigned int vlen, int flags)
+{
+    int nb_sent = -1;
+    int is_done = 0;
+
+    picoquic_msg_x_resolve();
+    if (vlen > PICOQUIC_PACKET_LOOP_BATCH_MAX) {
+        vlen = PICOQUIC_PACKET_LOOP_BATCH_MAX;
+    }
+    if (picoquic_sendmsg_x_fn != NULL && !picoquic_sendmsg_x_disabled) {
+        struct msghdr_x msgs_x[PICOQUIC_PACKET_LOOP_BATCH_MAX];
+
+        picoquic_msg_x_from_mmsg(msgs_x, msgs, vlen);
+        if ((nb_sent = (int)picoquic_sendmsg_x_fn(fd, msgs_x, vlen, flags)) >= 0) {
+            for (int i = 0; i < nb_sent; i++) {
+                msgs[i].msg_len = (unsigned int)msgs[i].msg_hdr.msg_iov[0].iov_len;
+            }
+            is_done = 1;
+        }
+        else if (picoquic_msg_x_is_unsupported(errno)) {
+            DBG_PRINTF("sendmsg_x not supported, err= %d, using sendmsg", errno);
+            picoquic_sendmsg_x_disabled = 1;
+        }
+        else {
+            is_done = 1;
+        }
+    }
+    if (!is_done) {
+        nb_sent = 0;
+        while (nb_sent < (int)vlen) {
+            ssize_t bytes_sent = sendmsg(fd, &msgs[nb_sent].msg_hdr, flags);
+            if (bytes_sent < 0) {
+                if (nb_sent == 0) {
+                    nb_sent = -1;
+                }
+                break;
+            }
+            msgs[nb_sent].msg_len = (unsigned int)bytes_sent;
+            nb_sent++;
+        }
+    }
+    return nb_sent;
+}
+#else
+#define picoquic_recvmmsg recvmmsg
+#define picoquic_sendmmsg sendmmsg
+#endif
+#endif
+
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+/* Batched I/O using recvmmsg and sendmmsg.
+ * The batch context holds a ring of preallocated slots, each with its
+ * own data buffer, addresses and control message buffer, plus the
+ * arrays of mmsghdr and iovec passed to the system calls. The same
+ * structure is used for receiving, with buffers sized for a single
+ * packet, and for sending, with buffers sized for a GSO train.
+ */
+#define PICOQUIC_PACKET_LOOP_CMSG_SIZE 256
+
+typedef struct st_picoquic_packet_loop_slot_t {
+    uint8_t* buffer;
+    size_t length;
+    size_t send_msg_size;
+    size_t udp_coalesced_size;
+    uint64_t txtime;
+    uint64_t receive_time;
+    struct sockaddr_storage addr_peer;
+    struct sockaddr_storage addr_local;
+    int if_index;
+    unsigned char ecn;
+    picoquic_cnx_t* cnx;
+    picoquic_connection_id_t log_cid;
+    char cmsg_buffer[PICOQUIC_PACKET_LOOP_CMSG_SIZE];
+} picoquic_packet_loop_slot_t;
+
+typedef struct st_picoquic_packet_loop_batch_t {
+    int depth;
+    int nb_msg;
+    size_t buffer_size;
+    SOCKET_TYPE fd;
+    uint8_t* buffers;
+    picoquic_packet_loop_slot_t* slots;
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+} picoquic_packet_loop_batch_t;
+
+static void picoquic_packet_loop_batch_delete(picoquic_packet_loop_batch_t* batch)
+{
+    if (batch != NULL) {
+        if (batch->buffers != NULL) {
+            free(batch->buffers);
+        }
+        if (batch->slots != NULL) {
+            free(batch->slots);
+        }
+        if (batch->msgs != NULL) {
+            free(batch->msgs);
+        }
+        if (batch->iovs != NULL) {
+            free(batch->iovs);
+        }
+        free(batch);
+    }
+}
+
+static picoquic_packet_loop_batch_t* picoquic_packet_loop_batch_create(int depth, size_t buffer_size)
+{
+    picoquic_packet_loop_batch_t* batch = (picoquic_packet_loop_batch_t*)malloc(sizeof(picoquic_packet_loop_batch_t));
+
+    if (batch != NULL) {
+        memset(batch, 0, sizeof(picoquic_packet_loop_batch_t));
+        batch->depth = depth;
+        batch->buffer_size = buffer_size;
+        batch->fd = INVALID_SOCKET;
+        batch->buffers = (uint8_t*)malloc(buffer_size * depth);
+        batch->slots = (picoquic_packet_loop_slot_t*)malloc(sizeof(picoquic_packet_loop_slot_t) * depth);
+        batch->msgs = (struct mmsghdr*)malloc(sizeof(struct mmsghdr) * depth);
+        batch->iovs = (struct iovec*)malloc(sizeof(struct iovec) * depth);
+
+        if (batch->buffers == NULL || batch->slots == NULL || batch->msgs == NULL || batch->iovs == NULL) {
+            picoquic_packet_loop_batch_delete(batch);
+            batch = NULL;
+        }
+        else {
+            memset(batch->slots, 0, sizeof(picoquic_packet_loop_slot_t) * depth);
+            memset(batch->msgs, 0, sizeof(struct mmsghdr) * depth);
+            for (int i = 0; i < depth; i++) {
+                batch->slots[i].buffer = batch->buffers + i * buffer_size;
+            }
+        }
+    }
+    return batch;
+}
+
+/* Receive up to batch->depth datagrams from the socket in a single call.
+ * Returns the total number of bytes received, 0 if no data was available,
+ * or -1 if the socket returned an error. */
+static int picoquic_packet_loop_recv_batch(picoquic_socket_ctx_t* s_ctx, picoquic_packet_loop_batch_t* batch)
+{
+    int bytes_recv = 0;
+    int nb_msg;
+
+    for (int i = 0; i < batch->depth; i++) {
+        picoquic_packet_loop_slot_t* slot = &batch->slots[i];
+        batch->iovs[i].iov_base = slot->buffer;
+        batch->iovs[i].iov_len = batch->buffer_size;
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->msgs[i].msg_hdr.msg_name = &slot->addr_peer;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_control = slot->cmsg_buffer;
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(slot->cmsg_buffer);
+    }
+
+    batch->nb_msg = 0;
+    nb_msg = picoquic_recvmmsg(s_ctx->fd, batch->msgs, batch->depth, MSG_DONTWAIT, NULL);
+
+    if (nb_msg < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            nb_msg = 0;
+        }
+        else {
+            DBG_PRINTF("Could not receive packets on UDP socket %d, err= %d!\n",
+                (int)s_ctx->fd, errno);
+            bytes_recv = -1;
+        }
+    }
+
+    for (int i = 0; i < nb_msg; i++) {
+        picoquic_packet_loop_slot_t* slot = &batch->slots[i];
+
+        slot->length = batch->msgs[i].msg_len;
+        slot->udp_coalesced_size = 0;
+        slot->if_index = 0;
+        slot->ecn = 0;
+        slot->receive_time = 0;
+        memset(&slot->addr_local, 0, sizeof(struct sockaddr_storage));
+        picoquic_socks_cmsg_parse_ex(&batch->msgs[i].msg_hdr, &slot->addr_local, &slot->if_index, &slot->ecn,
+            &slot->udp_coalesced_size, &slot->receive_time);
+        picoquic_packet_loop_set_dest_port(s_ctx, &slot->addr_local);
+        bytes_recv += (int)slot->length;
+    }
+    batch->nb_msg = nb_msg;
+
+    return bytes_recv;
+}
+#endif
+
+#ifndef _WINDOWS
+/* Receive timestamps are only used if they fall after the previous call
+ * to the stack. Earlier timestamps, e.g., for packets that were queued while
+ * the loop was busy, are moved up to the time of that call. */
+static uint64_t picoquic_packet_loop_receive_time(uint64_t timestamp, uint64_t floor_time, uint64_t current_time)
+{
+    if (timestamp == 0 || timestamp > current_time) {
+        timestamp = current_time;
+    }
+    else if (timestamp < floor_time) {
+        timestamp = floor_time;
+    }
+    return timestamp;
+}
+
+/* Submit a received buffer to the stack. If the datagrams were coalesced
+ * by UDP GRO, the buffer holds a series of segments of segment_size bytes,
+ * except for the last one which may be shorter, and each segment is
+ * submitted separately. The number of datagrams is returned in nb_segments.
+ */
+static int picoquic_packet_loop_incoming_segments(picoquic_quic_t* quic,
+    uint8_t* buffer, size_t length, size_t segment_size,
+    struct sockaddr* addr_from, struct sockaddr* addr_to, int if_index, unsigned char ecn,
+    picoquic_cnx_t** last_cnx, uint64_t receive_time, uint64_t current_time, unsigned int* nb_segments)
+{
+    picoquic_incoming_datagram_t datagram;
+
+    datagram.bytes = buffer;
+    datagram.length = length;
+    datagram.segment_size = segment_size;
+    datagram.addr_from = addr_from;
+    datagram.addr_to = addr_to;
+    datagram.if_index_to = if_index;
+    datagram.received_ecn = ecn;
+    datagram.receive_time = receive_time;
+    *nb_segments = (segment_size == 0 || segment_size >= length) ? 1 :
+        (unsigned int)((length + segment_size - 1) / segment_size);
+
+    return picoquic_incoming_packets(quic, &datagram, 1, last_cnx, current_time);
+}
+#endif
+
+/* Add the time elapsed since start_time to the histogram, and return the current time */
+static uint64_t picoquic_packet_loop_latency_add(picoquic_latency_histogram_t* histogram, uint64_t start_time)
+{
+    uint64_t now = picoquic_current_time();
+
+    picoquic_latency_histogram_add(histogram, (now > start_time) ? now - start_time : 0);
+
+    return now;
+}
+
+/* The latencies are measured if the application asked for reports, or if the
+ * metrics are enabled. In that case, the histograms are part of the metrics. */
+static picoquic_loop_latency_t* picoquic_packet_loop_get_latency(picoquic_quic_t* quic,
+    picoquic_packet_loop_options_t* options, picoquic_loop_latency_t* local_latency)
+{
+    picoquic_loop_latency_t* loop_latency = NULL;
+
+    if (quic->metrics != NULL) {
+        loop_latency = &quic->metrics->live.loop_latency;
+    }
+    else if (options->do_latency_report) {
+        loop_latency = local_latency;
+    }
+
+    return loop_latency;
+}
+
+int picoquic_packet_loop_monitor_system_call_duration(packet_loop_system_call_duration_t* sc_duration, uint64_t current_time, uint64_t previous_time)
+{
+    uint64_t duration = current_time - previous_time;
+    int64_t dev = sc_duration->scd_smoothed - duration;
+    int shall_notify = 0;
+
+    if (duration > sc_duration->scd_max) {
+        shall_notify = 1;
+        sc_duration->scd_max = duration;
+    }
+    else if (duration != sc_duration->scd_last) {
+        int64_t delta_d = sc_duration->scd_last - duration;
+
+        if (delta_d > 1000 || delta_d < -1000 || delta_d < (int64_t)sc_duration->scd_last) {
+            shall_notify = 1;
+        }
+        sc_duration->scd_last = duration;
+    }
+
+    sc_duration->scd_smoothed = (duration + 15 * sc_duration->scd_smoothed) / 16;
+    if (dev < 0) {
+        dev = -dev;
+    }
+    sc_duration->scd_dev = (7 * sc_duration->scd_dev + dev) / 8;
+
+    return shall_notify;
+}
+
+
+/* We have multiple sockets, with support for
+* either IPv6, or IPv4, or both, and binding to a port number.
+* Find the first socket where:
+* - the destination AF is supported.
+* - either the source port is not specified, or it matches the local port.
+*/
+SOCKET_TYPE picoquic_packet_loop_get_send_socket(picoquic_socket_ctx_t* s_ctx, int nb_sockets,
+    picoquic_packet_loop_param_t* param, struct sockaddr_storage* peer_addr, struct sockaddr_storage* local_addr)
+{
+    SOCKET_TYPE send_socket = INVALID_SOCKET;
+    uint16_t send_port = (peer_addr->ss_family == AF_INET) ?
+        ((struct sockaddr_in*)local_addr)->sin_port :
+        ((struct sockaddr_in6*)local_addr)->sin6_port;
+
+    /* TODO: verify htons/ntohs */
+    for (int i = 0; i < nb_sockets; i++) {
+        if (s_ctx[i].af == peer_addr->ss_family) {
+            send_socket = s_ctx[i].fd;
+            if (send_port == 0 && !param->prefer_extra_socket) {
+                break;
+            }
+            if (s_ctx[i].n_port == send_port) {
+                break;
+            }
+        }
+    }
+    return send_socket;
+}
+
+/* Handle a failed send: log the error, and notify the connection if the
+ * error implies that the destination is unreachable. If the error is EIO,
+ * retry the send one packet at a time and disable GSO for the rest of the run.
+ */
+void picoquic_packet_loop_send_error(picoquic_quic_t* quic, picoquic_cnx_t* last_cnx,
+    picoquic_connection_id_t* log_cid, SOCKET_TYPE send_socket,
+    struct sockaddr_storage* peer_addr, struct sockaddr_storage* local_addr, int if_index,
+    const uint8_t* send_buffer, size_t send_length, size_t send_msg_size,
+    int sock_ret, int sock_err, size_t** send_msg_ptr, uint64_t current_time)
+{
+    /* TODO: add a test in which the socket fails. */
+    if (last_cnx == NULL) {
+        picoquic_log_context_free_app_message(quic, log_cid, "Could not send message to AF_to=%d, AF_from=%d, if=%d, ret=%d, err=%d",
+            peer_addr->ss_family, local_addr->ss_family, if_index, sock_ret, sock_err);
+    }
+    else {
+        picoquic_log_app_message(last_cnx, "Could not send message to AF_to=%d, AF_from=%d, if=%d, ret=%d, err=%d",
+            peer_addr->ss_family, local_addr->ss_family, if_index, sock_ret, sock_err);
+
+        if (picoquic_socket_error_implies_unreachable(sock_err)) {
+            picoquic_notify_destination_unreachable(last_cnx, current_time,
+                (struct sockaddr*)peer_addr, (struct sockaddr*)local_addr, if_index,
+                sock_err);
+        }
+        else if (sock_err == EIO) {
+            /* TODO: this is an error encountered if the system supports GSO, but
+             * the specific interface driver does not. Main example is Mininet.
+             * Not sure that we can treat that correctly. Try to minimize the
+             * amount of untested code? Rely on config flag? Rely on error
+             * recovery? */
+            size_t packet_index = 0;
+            size_t packet_size = send_msg_size;
+
+            while (packet_index < send_length) {
+                if (packet_index + packet_size > send_length) {
+                    packet_size = send_length - packet_index;
+                }
+                sock_ret = picoquic_sendmsg(send_socket,
+                    (struct sockaddr*)peer_addr, (struct sockaddr*)local_addr, if_index,
+                    (const char*)(send_buffer + packet_index), (int)packet_size, 0, &sock_err);
+                if (sock_ret > 0) {
+                    packet_index += packet_size;
+                }
+                else {
+                    picoquic_log_app_message(last_cnx, "Retry with packet size=%zu fails at index %zu, ret=%d, err=%d.",
+                        packet_size, packet_index, sock_ret, sock_err);
+                    break;
+                }
+            }
+            if (sock_ret > 0) {
+                picoquic_log_app_message(last_cnx, "Retry of %zu bytes by chunks of %zu bytes succeeds.",
+                    send_length, send_msg_size);
+            }
+            if (*send_msg_ptr != NULL) {
+                /* Make sure that we do not use GSO anymore in this run */
+                *send_msg_ptr = NULL;
+                picoquic_log_app_message(last_cnx, "%s", "UDP GSO was disabled");
+            }
+        }
+    }
+}
+
+/* Connections may be deleted while queued messages are waiting to be sent,
+ * for example if a later call to prepare packet finds that the connection is
+ * closed. Before reporting an error on a queued message, verify that the
+ * connection that prepared it is still present. */
+picoquic_cnx_t* picoquic_packet_loop_check_cnx(picoquic_quic_t* quic, picoquic_cnx_t* cnx,
+    picoquic_connection_id_t* log_cid)
+{
+    picoquic_cnx_t* next_cnx = NULL;
+
+    if (cnx != NULL) {
+        next_cnx = picoquic_get_first_cnx(quic);
+        while (next_cnx != NULL && next_cnx != cnx) {
+            next_cnx = picoquic_get_next_cnx(next_cnx);
+        }
+        if (next_cnx != NULL && picoquic_compare_connection_id(&next_cnx->initial_cnxid, log_cid) != 0) {
+            next_cnx = NULL;
+        }
+    }
+    return next_cnx;
+}
+
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+/* Send all the messages queued in the batch through batch->fd, using as few
+ * calls to sendmmsg as possible. If a message fails, handle the error for
+ * that message and continue with the next one. */
+static void picoquic_packet_loop_batch_flush(picoquic_quic_t* quic, picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_batch_t* batch, size_t** send_msg_ptr, uint64_t current_time,
+    picoquic_latency_histogram_t* send_latency)
+{
+    int nb_done = 0;
+    uint64_t send_start = 0;
+
+    for (int i = 0; i < batch->nb_msg; i++) {
+        picoquic_packet_loop_slot_t* slot = &batch->slots[i];
+        batch->iovs[i].iov_base = slot->buffer;
+        batch->iovs[i].iov_len = slot->length;
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->msgs[i].msg_hdr.msg_name = &slot->addr_peer;
+        batch->msgs[i].msg_hdr.msg_namelen = picoquic_addr_length((struct sockaddr*)&slot->addr_peer);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_control = slot->cmsg_buffer;
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(slot->cmsg_buffer);
+        picoquic_socks_cmsg_format_ex(&batch->msgs[i].msg_hdr, slot->length, slot->send_msg_size,
+            (struct sockaddr*)&slot->addr_local, slot->if_index, slot->txtime);
+    }
+
+    if (send_latency != NULL) {
+        send_start = picoquic_current_time();
+    }
+    while (nb_done < batch->nb_msg) {
+        picoquic_packet_loop_slot_t* slot = &batch->slots[nb_done];
+        int nb_try = batch->nb_msg - nb_done;
+        int nb_sent = 0;
+        int sock_err = 0;
+
+        if (param->simulate_eio) {
+            /* Test hook, simulating a driver that does not support GSO */
+            for (int i = nb_done; i < batch->nb_msg; i++) {
+                if (batch->slots[i].length > PICOQUIC_MAX_PACKET_SIZE) {
+                    nb_try = i - nb_done;
+                    break;
+                }
+            }
+        }
+
+        if (nb_try == 0) {
+            nb_sent = -1;
+            sock_err = EIO;
+            param->simulate_eio = 0;
+        }
+        else if ((nb_sent = picoquic_sendmmsg(batch->fd, batch->msgs + nb_done, nb_try, 0)) <= 0) {
+            sock_err = errno;
+        }
+
+        if (nb_sent > 0) {
+            nb_done += nb_sent;
+        }
+        else {
+            picoquic_cnx_t* cnx = picoquic_packet_loop_check_cnx(quic, slot->cnx, &slot->log_cid);
+            picoquic_packet_loop_send_error(quic, cnx, &slot->log_cid, batch->fd,
+                &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+                slot->send_msg_size, nb_sent, sock_err, send_msg_ptr, current_time);
+            nb_done++;
+        }
+    }
+    if (send_latency != NULL) {
+        (void)picoquic_packet_loop_latency_add(send_latency, send_start);
+    }
+    batch->nb_msg = 0;
+}
+
+/* Prepare packets until there is nothing more to send or the limit is reached,
+ * queuing them in the batch and sending them with sendmmsg. A batch is sent
+ * through a single socket. If a packet requires a different socket, the messages
+ * already queued are sent first. The packets are prepared at *send_time, which
+ * may be moved forward if txtime_horizon is set. */
+static int picoquic_packet_loop_send_batch(picoquic_quic_t* quic, picoquic_packet_loop_param_t* param,
+    picoquic_socket_ctx_t* s_ctx, int nb_sockets, picoquic_packet_loop_batch_t* batch,
+    uint64_t current_time, uint64_t txtime_horizon, uint64_t* send_time, size_t** send_msg_ptr, size_t* bytes_sent,
+    picoquic_loop_latency_t* loop_latency)
+{
+    picoquic_latency_histogram_t* send_latency = (loop_latency == NULL) ? NULL : &loop_latency->send;
+    int ret = 0;
+    size_t nb_packets_sent = 0;
+    size_t send_max = picoquic_get_packet_loop_send_max(quic);
+
+    if (txtime_horizon > 0 && send_max < PICOQUIC_PACKET_LOOP_TXTIME_SEND_MAX) {
+        send_max = PICOQUIC_PACKET_LOOP_TXTIME_SEND_MAX;
+    }
+    if ((size_t)batch->depth > send_max) {
+        send_max = (size_t)batch->depth;
+    }
+
+    batch->nb_msg = 0;
+    batch->fd = INVALID_SOCKET;
+
+    while (ret == 0 && nb_packets_sent < send_max) {
+        picoquic_packet_loop_slot_t* slot = &batch->slots[batch->nb_msg];
+        SOCKET_TYPE send_socket;
+
+        slot->if_index = param->dest_if;
+        slot->send_msg_size = 0;
+        memset(&slot->addr_local, 0, sizeof(struct sockaddr_storage));
+
+        if (loop_latency != NULL) {
+            uint64_t prepare_start = picoquic_current_time();
+            ret = picoquic_prepare_next_packet_ex(quic, *send_time,
+                slot->buffer, batch->buffer_size, &slot->length,
+                &slot->addr_peer, &slot->addr_local, &slot->if_index, &slot->log_cid, &slot->cnx,
+                (*send_msg_ptr == NULL) ? NULL : &slot->send_msg_size);
+            (void)picoquic_packet_loop_latency_add(&loop_latency->prepare, prepare_start);
+        }
+        else {
+            ret = picoquic_prepare_next_packet_ex(quic, *send_time,
+                slot->buffer, batch->buffer_size, &slot->length,
+                &slot->addr_peer, &slot->addr_local, &slot->if_index, &slot->log_cid, &slot->cnx,
+                (*send_msg_ptr == NULL) ? NULL : &slot->send_msg_size);
+        }
+
+        if (ret != 0 || slot->length == 0) {
+            if (ret == 0 && picoquic_packet_loop_txtime_advance(quic, current_time, txtime_horizon, send_time)) {
+                /* Count the attempt, so the loop stays bounded */
+                nb_packets_sent++;
+                continue;
+            }
+            break;
+        }
+        slot->txtime = (*send_time > current_time) ? picoquic_packet_loop_txtime(*send_time) : 0;
+
+        nb_packets_sent += (slot->send_msg_size == 0) ? 1 :
+            (slot->length + slot->send_msg_size - 1) / (slot->send_msg_size);
+        if (slot->length > param->send_length_max) {
+            param->send_length_max = slot->length;
+        }
+        *bytes_sent += slot->length;
+
+        send_socket = picoquic_packet_loop_get_send_socket(s_ctx, nb_sockets, param,
+            &slot->addr_peer, &slot->addr_local);
+
+        if (send_socket == INVALID_SOCKET) {
+            picoquic_packet_loop_send_error(quic, slot->cnx, &slot->log_cid, send_socket,
+                &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+                slot->send_msg_size, -1, -1, send_msg_ptr, current_time);
+            continue;
+        }
+
+        if (batch->nb_msg > 0 && send_socket != batch->fd) {
+            /* Send the messages queued for the previous socket, and move
+             * the new message to the first slot. */
+            int last_msg = batch->nb_msg;
+            picoquic_packet_loop_slot_t first_slot = batch->slots[0];
+
+            picoquic_packet_loop_batch_flush(quic, param, batch, send_msg_ptr, current_time, send_latency);
+            batch->slots[0] = batch->slots[last_msg];
+            batch->slots[last_msg] = first_slot;
+        }
+        batch->fd = send_socket;
+        batch->nb_msg++;
+
+        if (batch->nb_msg >= batch->depth) {
+            picoquic_packet_loop_batch_flush(quic, param, batch, send_msg_ptr, current_time, send_latency);
+        }
+    }
+
+    if (batch->nb_msg > 0) {
+        picoquic_packet_loop_batch_flush(quic, param, batch, send_msg_ptr, current_time, send_latency);
+    }
+
+    return ret;
+}
+#endif
+
+#if defined(__linux__)
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#define PICOQUIC_PACKET_LOOP_NUMA_NODES_MAX 1024
+#endif
+
+/* Pin the thread running the loop to the requested CPU, and make the memory
+ * that it allocates come from the local NUMA node. This is called by the loop
+ * variants before they open the sockets and allocate their buffers. Failures
+ * are not fatal, the loop runs unpinned. */
+void picoquic_packet_loop_set_affinity(picoquic_packet_loop_param_t* param)
+{
+#if defined(_WINDOWS)
+    if (param->pin_to_cpu) {
+        if (param->cpu_index < 0 || param->cpu_index >= (int)(8 * sizeof(DWORD_PTR)) ||
+            SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR)1) << param->cpu_index) == 0) {
+            DBG_PRINTF("Cannot pin the network thread to CPU %d", param->cpu_index);
+        }
+    }
+    if (param->numa_local && param->cpu_index >= 0) {
+        /* Windows allocates memory from the node of the ideal processor of the thread */
+        if (SetThreadIdealProcessor(GetCurrentThread(), (DWORD)param->cpu_index) == (DWORD)-1) {
+            DBG_PRINTF("Cannot set the ideal processor to CPU %d", param->cpu_index);
+        }
+    }
+#elif defined(__linux__)
+    if (param->pin_to_cpu) {
+        cpu_set_t cpu_set;
+
+        CPU_ZERO(&cpu_set);
+        if (param->cpu_index < 0 || param->cpu_index >= CPU_SETSIZE) {
+            DBG_PRINTF("Invalid CPU index %d", param->cpu_index);
+        }
+        else {
+            CPU_SET(param->cpu_index, &cpu_set);
+            if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+                DBG_PRINTF("Cannot pin the network thread to CPU %d, err=%d", param->cpu_index, errno);
+            }
+        }
+    }
+    if (param->numa_local) {
+        unsigned int cpu = 0;
+        unsigned int node = 0;
+
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= PICOQUIC_PACKET_LOOP_NUMA_NODES_MAX) {
+            DBG_PRINTF("Cannot find the NUMA node of the network thread, err=%d", errno);
+        }
+        else {
+            unsigned long node_mask[PICOQUIC_PACKET_LOOP_NUMA_NODES_MAX / (8 * sizeof(unsigned long))];
+            size_t bits_per_long = 8 * sizeof(unsigned long);
+
+            memset(node_mask, 0, sizeof(node_mask));
+            node_mask[node / bits_per_long] |= 1ul << (node % bits_per_long);
+            /* The kernel reads maxnode - 1 bits */
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask, (unsigned long)PICOQUIC_PACKET_LOOP_NUMA_NODES_MAX + 1) != 0) {
+                DBG_PRINTF("Cannot prefer NUMA node %u, err=%d", node, errno);
+            }
+        }
+    }
+#else
+    if (param->pin_to_cpu || param->numa_local) {
+        DBG_PRINTF("%s", "CPU pinning is not supported on this platform");
+    }
+#endif
+}
+
+static void picoquic_packet_loop_async_wake(void* v_thread_ctx)
+{
+    (void)picoquic_wake_up_network_thread((picoquic_network_thread_ctx_t*)v_thread_ctx);
+}
+
+#ifdef _WINDOWS
+    DWORD WINAPI picoquic_packet_loop_v3(LPVOID v_ctx)
+#else
+void* picoquic_packet_loop_v3(void* v_ctx)
+#endif
+{
+    picoquic_network_thread_ctx_t* thread_ctx = (picoquic_network_thread_ctx_t*)v_ctx;
+    picoquic_quic_t* quic = thread_ctx->quic;
+    picoquic_packet_loop_param_t* param = thread_ctx->param;
+    picoquic_packet_loop_cb_fn loop_callback = thread_ctx->loop_callback;
+    void* loop_callback_ctx = thread_ctx->loop_callback_ctx;
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    int64_t delay_max = 10000000;
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_to;
+    int if_index_to;
+#ifndef _WINDOWS
+    uint8_t* buffer = NULL;
+    size_t recv_buffer_size = PICOQUIC_MAX_JUMBO_PACKET_SIZE;
+#endif
+    uint8_t* send_buffer = NULL;
+    size_t send_length = 0;
+    size_t send_msg_size = 0;
+    size_t send_buffer_size = param->socket_buffer_size;
+    size_t* send_msg_ptr = NULL;
+    int bytes_recv;
+    picoquic_connection_id_t log_cid;
+    picoquic_socket_ctx_t s_ctx[4];
+    int nb_sockets = 0;
+    int nb_sockets_available = 0;
+    picoquic_cnx_t* last_cnx = NULL;
+    int loop_immediate = 0;
+    unsigned int nb_loop_immediate = 0;
+    picoquic_packet_loop_options_t options = { 0 };
+    packet_loop_system_call_duration_t sc_duration = { 0 };
+    picoquic_loop_latency_t local_latency = { 0 };
+    picoquic_loop_latency_t* loop_latency = NULL;
+    uint64_t next_latency_report = 0;
+    unsigned int recv_max = (unsigned int)picoquic_get_packet_loop_recv_max(quic);
+    uint64_t txtime_horizon = 0;
+    uint64_t stack_time = 0;
+    uint64_t spin_start = 0;
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+    picoquic_packet_loop_batch_t* recv_batch = NULL;
+    picoquic_packet_loop_batch_t* send_batch = NULL;
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_POLL
+    picoquic_packet_loop_poll_t* poll_ctx = NULL;
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+    picoquic_packet_loop_zc_pool_t* zc_pool = NULL;
+#endif
+
+    int is_wake_up_event;
+#ifdef _WINDOWS
+    WSADATA wsaData = { 0 };
+    (void)WSA_START(MAKEWORD(2, 2), &wsaData);
+#else
+    if (param->io_provider != NULL) {
+        /* Packets are sent and received through the I/O provider */
+        return picoquic_packet_loop_provider(v_ctx);
+    }
+#endif
+
+    if (thread_ctx->thread_name != NULL) {
+        thread_ctx->thread_setname_fn(thread_ctx->thread_name);
+    }
+    picoquic_packet_loop_set_affinity(param);
+
+    if (send_buffer_size == 0) {
+        send_buffer_size = 0xffff;
+    }
+
+    /* The loop owns the receive buffers, so short header packets can be decrypted in place */
+    picoquic_set_in_place_decryption(quic, 1);
+
+    memset(s_ctx, 0, sizeof(s_ctx));
+    for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+        s_ctx[i].reuse_port = (param->reuse_port) ? 1 : 0;
+        s_ctx[i].reuseport_steering_shards = param->reuseport_steering_shards;
+        s_ctx[i].use_txtime = (param->txtime_horizon > 0) ? 1 : 0;
+        s_ctx[i].use_zerocopy = (param->zerocopy_pool_size > 0) ? 1 : 0;
+        s_ctx[i].use_rx_timestamps = (param->use_receive_timestamps) ? 1 : 0;
+        s_ctx[i].busy_poll_usec = (param->busy_poll_budget > 0) ? PICOQUIC_PACKET_LOOP_BUSY_POLL_USEC : 0;
+        s_ctx[i].use_gro = 1;
+    }
+    if ((nb_sockets = picoquic_packet_loop_open_sockets(param->local_port,
+        param->local_af, param->socket_buffer_size,
+        param->extra_socket_required, param->do_not_use_gso, s_ctx)) <= 0) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else if (loop_callback != NULL) {
+        struct sockaddr_storage l_addr;
+        ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+
+        if (picoquic_store_loopback_addr(&l_addr, s_ctx[0].af, s_ctx[0].port) == 0) {
+            ret = loop_callback(quic, picoquic_packet_loop_port_update, loop_callback_ctx, &l_addr);
+        }
+        if (ret == 0 && options.provide_alt_port) {
+            int alt_sock = (nb_sockets > 2 && param->local_af == 0) ? 2 : 1;
+            uint16_t alt_port = s_ctx[alt_sock].port;
+            ret = loop_callback(quic, picoquic_packet_loop_alt_port, loop_callback_ctx, &alt_port);
+        }
+    }
+
+    if (ret == 0) {
+        nb_sockets_available = nb_sockets;
+
+        if (udp_gso_available && !param->do_not_use_gso) {
+            send_buffer_size = 0xFFFF;
+            send_msg_ptr = &send_msg_size;
+        }
+        /* Only send packets ahead of time if all sockets accepted SO_TXTIME */
+        txtime_horizon = param->txtime_horizon;
+        for (int i = 0; i < nb_sockets; i++) {
+            if (!s_ctx[i].use_txtime) {
+                txtime_horizon = 0;
+            }
+        }
+        send_buffer = malloc(send_buffer_size);
+        if (send_buffer == NULL) {
+            ret = -1;
+        }
+#ifndef _WINDOWS
+        /* Sockets with UDP GRO may deliver up to 64KB of coalesced datagrams in one read */
+        for (int i = 0; i < nb_sockets; i++) {
+            if (s_ctx[i].supports_udp_recv_coalesced) {
+                recv_buffer_size = 0xFFFF;
+            }
+        }
+        if (ret == 0 && (buffer = (uint8_t*)malloc(recv_buffer_size)) == NULL) {
+            ret = -1;
+        }
+#endif
+    }
+
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+    if (ret == 0 && param->batch_depth > 1) {
+        int batch_depth = (param->batch_depth > PICOQUIC_PACKET_LOOP_BATCH_MAX) ?
+            PICOQUIC_PACKET_LOOP_BATCH_MAX : param->batch_depth;
+
+        if ((recv_batch = picoquic_packet_loop_batch_create(batch_depth, recv_buffer_size)) == NULL ||
+            (send_batch = picoquic_packet_loop_batch_create(batch_depth, send_buffer_size)) == NULL) {
+            DBG_PRINTF("Cannot allocate batches of %d messages", batch_depth);
+            ret = -1;
+        }
+        else if ((unsigned int)batch_depth > recv_max) {
+            recv_max = (unsigned int)batch_depth;
+        }
+    }
+#endif
+
+#ifdef PICOQUIC_PACKET_LOOP_POLL
+    if (ret == 0 && !param->use_select &&
+        (poll_ctx = picoquic_packet_loop_poll_create(s_ctx, nb_sockets, thread_ctx)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create the readiness queue, using select.");
+    }
+#endif
+
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+    /* With select, pending completions would make the sockets appear readable
+     * while no data can be read, hence zero copy requires the readiness queue. */
+    if (ret == 0 && param->zerocopy_pool_size > 0 && send_msg_ptr != NULL && poll_ctx != NULL
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+        && send_batch == NULL
+#endif
+        ) {
+        int use_zerocopy = 1;
+        for (int i = 0; i < nb_sockets; i++) {
+            if (!s_ctx[i].use_zerocopy) {
+                use_zerocopy = 0;
+            }
+        }
+        if (use_zerocopy &&
+            (zc_pool = picoquic_packet_loop_zc_create(param->zerocopy_pool_size, send_buffer_size)) == NULL) {
+            DBG_PRINTF("Cannot allocate %d zero copy buffers, copying sends.", param->zerocopy_pool_size);
+        }
+    }
+#endif
 
     if (ret == 0) {
+        if (thread_ctx->wake_up_defined && quic->async_wake_fn == NULL) {
+            /* Completion of asynchronous handshakes wakes up the loop */
+            picoquic_set_async_wake_fn(quic, picoquic_packet_loop_async_wake, thread_ctx);
+        }
         thread_ctx->thread_is_ready = 1;
     }
     else {
@@ -806,6 +2296,11 @@ void* picoquic_packet_loop_v3(void* v_ctx)
         uint8_t received_ecn;
         uint8_t* received_buffer;
         uint64_t previous_time;
+        uint64_t wait_end_time;
+#ifndef _WINDOWS
+        uint64_t rx_floor_time;
+#endif
+        int is_spinning = 0;
 
         if_index_to = 0;
         /* The "loop immediate" condition is set when a packet has been
@@ -818,6 +2313,7 @@ void* picoquic_packet_loop_v3(void* v_ctx)
         * of loops in "immediate" mode, and ignoring the "loop
         * immediate" condition if that number reaches a limit */
         current_time = picoquic_current_time();
+        loop_latency = picoquic_packet_loop_get_latency(quic, &options, &local_latency);
         if (!loop_immediate) {
             nb_loop_immediate = 1;
             delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
@@ -830,32 +2326,111 @@ void* picoquic_packet_loop_v3(void* v_ctx)
                     delta_t = time_check_arg.delta_t;
                 }
             }
+            if (param->busy_poll_budget > 0 && delta_t > 0) {
+                /* Busy poll: check the sockets without blocking until the spin budget is spent */
+                if (spin_start == 0) {
+                    spin_start = current_time;
+                }
+                if (current_time - spin_start < param->busy_poll_budget) {
+                    is_spinning = 1;
+                    delta_t = 0;
+                }
+            }
+        }
+        else {
+            nb_loop_immediate++;
+        }
+        /* The "loop immediate flag is set by default to zero. It will be
+        * set to 1 if a packet has been received and the number of
+        * packets received "immediately" does not exceed the limit.
+         */
+        loop_immediate = 0;
+        /* Remember the time before the select call, so it duration be monitored */
+        previous_time = current_time;
+#ifdef _WINDOWS
+        bytes_recv = picoquic_packet_loop_wait(s_ctx, nb_sockets_available,
+            &addr_from, &addr_to, &if_index_to, &received_ecn, &received_buffer,
+            delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
+#else
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+        if (recv_batch != NULL) {
+            /* The mmsg calls are defined on Linux, where epoll is always available,
+             * and emulated on Apple platforms, where kqueue is. */
+            if (poll_ctx != NULL) {
+                bytes_recv = picoquic_packet_loop_poll_wait(poll_ctx, nb_sockets_available,
+                    delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
+            }
+            else {
+                bytes_recv = picoquic_packet_loop_wait_readable(s_ctx, nb_sockets_available,
+                    delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
+            }
+            if (bytes_recv > 0) {
+                bytes_recv = picoquic_packet_loop_recv_batch(&s_ctx[socket_rank], recv_batch);
+                /* A short batch means that the socket queue was drained. */
+                if (poll_ctx != NULL && bytes_recv >= 0 && recv_batch->nb_msg < recv_batch->depth &&
+                    (recv_batch->nb_msg > 0 || errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    picoquic_packet_loop_poll_clear(poll_ctx, socket_rank);
+                }
+            }
+        }
+        else
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_POLL
+        if (poll_ctx != NULL) {
+            bytes_recv = picoquic_packet_loop_poll_recv(poll_ctx, s_ctx, nb_sockets_available,
+                &addr_from,
+                &addr_to, &if_index_to, &received_ecn,
+                buffer, (int)recv_buffer_size,
+                delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
+        }
+        else
+#endif
+        {
+            bytes_recv = picoquic_packet_loop_select(s_ctx, nb_sockets_available,
+                &addr_from,
+                &addr_to, &if_index_to, &received_ecn,
+                buffer, (int)recv_buffer_size,
+                delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
+        }
+        received_buffer = buffer;
+#endif
+        /* Refresh the clock cache once after the wait */
+        current_time = picoquic_refresh_quic_time(quic);
+        if (is_spinning && bytes_recv == 0 && !is_wake_up_event) {
+            /* Nothing yet, keep spinning */
+            continue;
+        }
+        if (delta_t > 0) {
+            /* The loop was blocked in the wait, and woke up */
+            picoquic_record_loop_wakeup(quic, current_time);
+        }
+        if (spin_start != 0) {
+            /* The spin ends with a packet or a wake up, or with the blocking wait */
+            if (loop_latency != NULL) {
+                uint64_t spin_end = (is_spinning) ? current_time : previous_time;
+                picoquic_latency_histogram_add(&loop_latency->spin, (spin_end > spin_start) ? spin_end - spin_start : 0);
+            }
+            spin_start = 0;
         }
-        else {
-            nb_loop_immediate++;
+        wait_end_time = current_time;
+        if (loop_latency != NULL) {
+            picoquic_latency_histogram_add(&loop_latency->wait, current_time - previous_time);
+            if (bytes_recv == 0 && !is_wake_up_event && delta_t > 0) {
+                /* The wait timed out, which should happen at the next wake time */
+                uint64_t planned_time = previous_time + (uint64_t)delta_t;
+                picoquic_latency_histogram_add(&loop_latency->wake_lag,
+                    (current_time > planned_time) ? current_time - planned_time : 0);
+            }
         }
-        /* The "loop immediate flag is set by default to zero. It will be
-        * set to 1 if a packet has been received and the number of
-        * packets received "immediately" does not exceed the limit.
-         */
-        loop_immediate = 0;
-        /* Remember the time before the select call, so it duration be monitored */
-        previous_time = current_time;
-#ifdef _WINDOWS
-        bytes_recv = picoquic_packet_loop_wait(s_ctx, nb_sockets_available,
-            &addr_from, &addr_to, &if_index_to, &received_ecn, &received_buffer,
-            delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
-#else
-        bytes_recv = picoquic_packet_loop_select(s_ctx, nb_sockets_available,
-            &addr_from,
-            &addr_to, &if_index_to, &received_ecn,
-            buffer, sizeof(buffer),
-            delta_t, &is_wake_up_event, thread_ctx, &socket_rank);
-        received_buffer = buffer;
+        if (current_time < stack_time) {
+            /* Packets were prepared ahead of time, the stack time shall not go back */
+            current_time = stack_time;
+        }
+#ifndef _WINDOWS
+        rx_floor_time = (stack_time > previous_time) ? stack_time : previous_time;
 #endif
-        current_time = picoquic_current_time();
         if (options.do_system_call_duration && delta_t == 0 &&
-            monitor_system_call_duration(&sc_duration, current_time, previous_time)) {
+            picoquic_packet_loop_monitor_system_call_duration(&sc_duration, current_time, previous_time)) {
             ret = loop_callback(quic, picoquic_packet_loop_system_call_duration,
                 loop_callback_ctx, &sc_duration);
         }
@@ -865,16 +2440,30 @@ void* picoquic_packet_loop_v3(void* v_ctx)
             ret = (thread_ctx->thread_should_close) ? PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP : -1;
         }
         else if (bytes_recv == 0 && is_wake_up_event) {
-            ret = loop_callback(quic, picoquic_packet_loop_wake_up, loop_callback_ctx, NULL);
+            /* When the thread is being deleted, just exit the loop */
+            if (!thread_ctx->thread_should_close) {
+                picoquic_run_network_commands(thread_ctx);
+                ret = loop_callback(quic, picoquic_packet_loop_wake_up, loop_callback_ctx, NULL);
+            }
         }
         else {
             uint64_t loop_time = current_time;
             size_t bytes_sent = 0;
             size_t nb_packets_sent = 0;
+            size_t send_max = picoquic_get_packet_loop_send_max(quic);
+
+            if (txtime_horizon > 0 && send_max < PICOQUIC_PACKET_LOOP_TXTIME_SEND_MAX) {
+                send_max = PICOQUIC_PACKET_LOOP_TXTIME_SEND_MAX;
+            }
 
             if (bytes_recv > 0) {
+                picoquic_receive_batch_start(quic);
 #ifdef _WINDOWS
                 size_t recv_bytes = 0;
+                if (s_ctx[socket_rank].udp_coalesced_size > 0) {
+                    picoquic_prepare_header_masks(quic, s_ctx[socket_rank].recv_buffer, (size_t)bytes_recv,
+                        s_ctx[socket_rank].udp_coalesced_size);
+                }
                 while (recv_bytes < (size_t)bytes_recv && ret == 0) {
                     size_t recv_length = (size_t)(bytes_recv - recv_bytes);
 
@@ -894,13 +2483,41 @@ void* picoquic_packet_loop_v3(void* v_ctx)
                     ret = picoquic_win_recvmsg_async_start(&s_ctx[socket_rank]);
                 }
 #else
-                /* Submit the packet to the server */
-                ret = picoquic_incoming_packet_ex(quic, received_buffer,
-                    (size_t)bytes_recv, (struct sockaddr*)&addr_from,
-                    (struct sockaddr*)&addr_to, if_index_to, received_ecn,
-                    &last_cnx, current_time);
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+                if (recv_batch != NULL) {
+                    /* Submit the packets received in the batch, and count them
+                     * against the limit of packets received in "immediate" mode. */
+                    unsigned int nb_datagrams = 0;
+                    for (int i = 0; ret == 0 && i < recv_batch->nb_msg; i++) {
+                        picoquic_packet_loop_slot_t* slot = &recv_batch->slots[i];
+                        unsigned int nb_segments = 0;
+                        ret = picoquic_packet_loop_incoming_segments(quic, slot->buffer,
+                            slot->length, slot->udp_coalesced_size, (struct sockaddr*)&slot->addr_peer,
+                            (struct sockaddr*)&slot->addr_local, slot->if_index, slot->ecn, &last_cnx,
+                            picoquic_packet_loop_receive_time(slot->receive_time, rx_floor_time, current_time),
+                            current_time, &nb_segments);
+                        nb_datagrams += nb_segments;
+                    }
+                    nb_loop_immediate += (nb_datagrams > 1) ? nb_datagrams - 1 : 0;
+                }
+                else
 #endif
-
+                {
+                    /* Submit the packet to the server, splitting GRO segments */
+                    unsigned int nb_segments = 0;
+                    ret = picoquic_packet_loop_incoming_segments(quic, received_buffer,
+                        (size_t)bytes_recv, s_ctx[socket_rank].udp_coalesced_size,
+                        (struct sockaddr*)&addr_from,
+                        (struct sockaddr*)&addr_to, if_index_to, received_ecn, &last_cnx,
+                        picoquic_packet_loop_receive_time(s_ctx[socket_rank].receive_time, rx_floor_time, current_time),
+                        current_time, &nb_segments);
+                    nb_loop_immediate += (nb_segments > 1) ? nb_segments - 1 : 0;
+                }
+#endif
+                picoquic_receive_batch_end(quic);
+                if (loop_latency != NULL) {
+                    (void)picoquic_packet_loop_latency_add(&loop_latency->receive, wait_end_time);
+                }
 
                 if (loop_callback != NULL) {
                     size_t b_recvd = (size_t)bytes_recv;
@@ -911,7 +2528,7 @@ void* picoquic_packet_loop_v3(void* v_ctx)
                 * reached the threshold, set the "immediate" flag and bypass
                 * the sending code. 
                  */
-                if (ret == 0 && nb_loop_immediate < PICOQUIC_PACKET_LOOP_RECV_MAX) {
+                if (ret == 0 && nb_loop_immediate < recv_max) {
                     loop_immediate = 1;
                     continue;
                 }
@@ -937,18 +2554,39 @@ void* picoquic_packet_loop_v3(void* v_ctx)
             * the code will not spend a lot of time sending packets while
             * packets may be adding in the receive queue.
              */
-
-            while (ret == 0 && nb_packets_sent < PICOQUIC_PACKET_LOOP_SEND_MAX) {
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+            if (send_batch != NULL) {
+                ret = picoquic_packet_loop_send_batch(quic, param, s_ctx, nb_sockets_available,
+                    send_batch, current_time, txtime_horizon, &loop_time, &send_msg_ptr, &bytes_sent,
+                    loop_latency);
+            }
+            else
+#endif
+            while (ret == 0 && nb_packets_sent < send_max) {
                 struct sockaddr_storage peer_addr;
                 struct sockaddr_storage local_addr = { 0 };
                 int if_index = param->dest_if;
                 int sock_ret = 0;
                 int sock_err = 0;
+                uint8_t* packet_buffer = send_buffer;
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+                int zc_index = (zc_pool == NULL) ? -1 : picoquic_packet_loop_zc_get(zc_pool, s_ctx, nb_sockets);
+
+                if (zc_index >= 0) {
+                    packet_buffer = zc_pool->buffers[zc_index].buffer;
+                }
+#endif
+
+                uint64_t prepare_start = (loop_latency == NULL) ? 0 : picoquic_current_time();
+                uint64_t send_start = 0;
 
                 ret = picoquic_prepare_next_packet_ex(quic, loop_time,
-                    send_buffer, send_buffer_size, &send_length,
+                    packet_buffer, send_buffer_size, &send_length,
                     &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx,
                     send_msg_ptr);
+                if (loop_latency != NULL) {
+                    send_start = picoquic_packet_loop_latency_add(&loop_latency->prepare, prepare_start);
+                }
 
                 if (ret == 0 && send_length > 0) {
                     /* If send_msg_size is defined, sendmsg may send more than one packet.
@@ -959,32 +2597,11 @@ void* picoquic_packet_loop_v3(void* v_ctx)
                     if (send_length > param->send_length_max) {
                         param->send_length_max = send_length;
                     }
-                    /* We have multiple sockets, with support for
-                    * either IPv6, or IPv4, or both, and binding to a port number.
-                    * Find the first socket where:
-                    * - the destination AF is supported.
-                    * - either the source port is not specified, or it matches the local port.
-                    */
-                    SOCKET_TYPE send_socket = INVALID_SOCKET;
-                    uint16_t send_port = (peer_addr.ss_family == AF_INET) ?
-                        ((struct sockaddr_in*)&local_addr)->sin_port :
-                        ((struct sockaddr_in6*)&local_addr)->sin6_port;
+                    SOCKET_TYPE send_socket = picoquic_packet_loop_get_send_socket(s_ctx, nb_sockets_available,
+                        param, &peer_addr, &local_addr);
 
                     bytes_sent += send_length;
 
-                    /* TODO: verify htons/ntohs */
-                    for (int i = 0; i < nb_sockets_available; i++) {
-                        if (s_ctx[i].af == peer_addr.ss_family) {
-                            send_socket = s_ctx[i].fd;
-                            if (send_port == 0 && !param->prefer_extra_socket) {
-                                break;
-                            }
-                            if (s_ctx[i].n_port == send_port) {
-                                break;
-                            }
-                        }
-                    }
-
                     if (send_socket == INVALID_SOCKET) {
                         sock_ret = -1;
                         sock_err = -1;
@@ -999,82 +2616,88 @@ void* picoquic_packet_loop_v3(void* v_ctx)
                             param->simulate_eio = 0;
                         }
                         else {
+#ifdef _WINDOWS
                             sock_ret = picoquic_sendmsg(send_socket,
                                 (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index,
-                                (const char*)send_buffer, (int)send_length, (int)send_msg_size, &sock_err);
-                        }
-                    }
-                    if (sock_ret <= 0) {
-                        /* TODO: add a test in which the socket fails. */
-                        if (last_cnx == NULL) {
-                            picoquic_log_context_free_app_message(quic, &log_cid, "Could not send message to AF_to=%d, AF_from=%d, if=%d, ret=%d, err=%d",
-                                peer_addr.ss_family, local_addr.ss_family, if_index, sock_ret, sock_err);
-                        }
-                        else {
-                            picoquic_log_app_message(last_cnx, "Could not send message to AF_to=%d, AF_from=%d, if=%d, ret=%d, err=%d",
-                                peer_addr.ss_family, local_addr.ss_family, if_index, sock_ret, sock_err);
-
-                            if (picoquic_socket_error_implies_unreachable(sock_err)) {
-                                picoquic_notify_destination_unreachable(last_cnx, current_time,
+                                (const char*)packet_buffer, (int)send_length, (int)send_msg_size, &sock_err);
+#else
+                            uint64_t txtime_ns = (loop_time > current_time) ? picoquic_packet_loop_txtime(loop_time) : 0;
+                            int send_flags = 0;
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+                            if (zc_index >= 0 && send_length >= PICOQUIC_PACKET_LOOP_ZEROCOPY_MIN) {
+                                send_flags = MSG_ZEROCOPY;
+                            }
+#endif
+                            sock_ret = picoquic_sendmsg_ex(send_socket,
+                                (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index,
+                                (const char*)packet_buffer, (int)send_length, (int)send_msg_size,
+                                txtime_ns, send_flags, &sock_err);
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+                            if (send_flags != 0 && sock_ret <= 0 && sock_err == ENOBUFS) {
+                                /* Out of option memory for pinning pages, send a copy instead */
+                                send_flags = 0;
+                                sock_ret = picoquic_sendmsg_ex(send_socket,
                                     (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index,
-                                    sock_err);
+                                    (const char*)packet_buffer, (int)send_length, (int)send_msg_size,
+                                    txtime_ns, 0, &sock_err);
                             }
-                            else if (sock_err == EIO) {
-                                /* TODO: this is an error encountered if the system supports GSO, but
-                                 * the specific interface driver does not. Main example is Mininet.
-                                 * Not sure that we can treat that correctly. Try to minimize the
-                                 * amount of untested code? Rely on config flag? Rely on error
-                                 * recovery? */
-                                size_t packet_index = 0;
-                                size_t packet_size = send_msg_size;
-
-                                while (packet_index < send_length) {
-                                    if (packet_index + packet_size > send_length) {
-                                        packet_size = send_length - packet_index;
-                                    }
-                                    sock_ret = picoquic_sendmsg(send_socket,
-                                        (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index,
-                                        (const char*)(send_buffer + packet_index), (int)packet_size, 0, &sock_err);
-                                    if (sock_ret > 0) {
-                                        packet_index += packet_size;
-                                    }
-                                    else {
-                                        picoquic_log_app_message(last_cnx, "Retry with packet size=%zu fails at index %zu, ret=%d, err=%d.",
-                                            packet_size, packet_index, sock_ret, sock_err);
-                                        break;
-                                    }
-                                }
-                                if (sock_ret > 0) {
-                                    picoquic_log_app_message(last_cnx, "Retry of %zu bytes by chunks of %zu bytes succeeds.",
-                                        send_length, send_msg_size);
-                                }
-                                if (send_msg_ptr != NULL) {
-                                    /* Make sure that we do not use GSO anymore in this run */
-                                    send_msg_ptr = NULL;
-                                    picoquic_log_app_message(last_cnx, "%s", "UDP GSO was disabled");
-                                }
+                            if (send_flags != 0 && sock_ret > 0) {
+                                picoquic_packet_loop_zc_sent(zc_pool, zc_index, s_ctx, nb_sockets, send_socket);
                             }
+#endif
+#endif
+                        }
+                        if (loop_latency != NULL) {
+                            (void)picoquic_packet_loop_latency_add(&loop_latency->send, send_start);
                         }
                     }
+                    if (sock_ret <= 0) {
+                        picoquic_packet_loop_send_error(quic, last_cnx, &log_cid, send_socket,
+                            &peer_addr, &local_addr, if_index, packet_buffer, send_length, send_msg_size,
+                            sock_ret, sock_err, &send_msg_ptr, current_time);
+                    }
+                }
+                else if (ret == 0 && picoquic_packet_loop_txtime_advance(quic, current_time, txtime_horizon, &loop_time)) {
+                    /* Count the attempt, so the loop stays bounded */
+                    nb_packets_sent++;
                 }
                 else {
                     break;
                 }
             }
+            if (loop_time > stack_time) {
+                stack_time = loop_time;
+            }
 
             if (ret == 0 && loop_callback != NULL) {
                 ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
             }
         }
+
+        if (ret == 0 && options.do_latency_report && current_time >= next_latency_report) {
+            if (next_latency_report != 0) {
+                ret = loop_callback(quic, picoquic_packet_loop_latency_report, loop_callback_ctx, loop_latency);
+            }
+            next_latency_report = current_time + PICOQUIC_PACKET_LOOP_LATENCY_REPORT_INTERVAL;
+        }
     }
 
     thread_ctx->thread_is_ready = 0;
+    if (quic->async_wake_fn == picoquic_packet_loop_async_wake && quic->async_wake_ctx == thread_ctx) {
+        picoquic_set_async_wake_fn(quic, NULL, NULL);
+    }
 
     if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
         /* Normal termination requested by the application, returns no error */
         ret = 0;
     }
 
+    if (options.do_latency_report && loop_callback != NULL) {
+        /* Final report, the loop is terminating so the return code does not matter */
+        (void)loop_callback(quic, picoquic_packet_loop_latency_report, loop_callback_ctx,
+            picoquic_packet_loop_get_latency(quic, &options, &local_latency));
+    }
+
     /* Close the sockets */
     for (int i = 0; i < nb_sockets; i++) {
         picoquic_packet_loop_close_socket(&s_ctx[i]);
@@ -1083,7 +2706,24 @@ void* picoquic_packet_loop_v3(void* v_ctx)
     if (send_buffer != NULL) {
         free(send_buffer);
     }
+#ifndef _WINDOWS
+    if (buffer != NULL) {
+        free(buffer);
+    }
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_MMSG
+    picoquic_packet_loop_batch_delete(recv_batch);
+    picoquic_packet_loop_batch_delete(send_batch);
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_POLL
+    picoquic_packet_loop_poll_delete(poll_ctx);
+#endif
+#ifdef PICOQUIC_PACKET_LOOP_ZEROCOPY
+    /* Pages still referenced by the kernel stay pinned until transmitted */
+    picoquic_packet_loop_zc_delete(zc_pool);
+#endif
     thread_ctx->return_code = ret;
+    thread_ctx->thread_is_closed = 1;
 #ifdef _WINDOWS
     return (DWORD)ret;
 #else
@@ -1106,7 +2746,27 @@ int picoquic_packet_loop_v2(picoquic_quic_t* quic,
     thread_ctx.loop_callback = loop_callback;
     thread_ctx.loop_callback_ctx = loop_callback_ctx;
 
-    (void)picoquic_packet_loop_v3((void*)&thread_ctx);
+    if (param->metrics_port != 0 &&
+        (thread_ctx.metrics_server = picoquic_start_metrics_server(quic, param->metrics_port,
+            param->metrics_bind_any, &thread_ctx.return_code)) == NULL) {
+        return thread_ctx.return_code;
+    }
+
+#ifdef _WINDOWS
+    if (param->use_rio) {
+        (void)picoquic_packet_loop_rio((void*)&thread_ctx);
+    }
+    else
+#else
+    if (param->use_io_uring) {
+        (void)picoquic_packet_loop_uring((void*)&thread_ctx);
+    }
+    else
+#endif
+    {
+        (void)picoquic_packet_loop_v3((void*)&thread_ctx);
+    }
+    picoquic_stop_metrics_server(thread_ctx.metrics_server);
     return thread_ctx.return_code;
 }
 
@@ -1140,8 +2800,15 @@ static void picoquic_close_network_wake_up(picoquic_network_thread_ctx_t* thread
 #ifdef _WINDOWS
         CloseHandle(thread_ctx->wake_up_event);
 #else
-        for (int i = 0; i < 2; i++) {
-            (void)close(thread_ctx->wake_up_pipe_fd[i]);
+        if (thread_ctx->wake_up_is_eventfd) {
+            (void)close(thread_ctx->wake_up_pipe_fd[0]);
+        }
+        else {
+            /* Close the write end first, so that a loop waiting on the read
+             * end sees the end of file and wakes up. */
+            for (int i = 1; i >= 0; i--) {
+                (void)close(thread_ctx->wake_up_pipe_fd[i]);
+            }
         }
 #endif
         thread_ctx->wake_up_defined = 0;
@@ -1160,6 +2827,22 @@ static void picoquic_open_network_wake_up(picoquic_network_thread_ctx_t* thread_
         thread_ctx->wake_up_defined = 1;
     }
 #else
+#if defined(PICOQUIC_WAKE_UP_EVENTFD)
+    if (thread_ctx->param == NULL || !thread_ctx->param->wake_up_use_pipe) {
+        /* The eventfd is left blocking, because it is only read after being
+         * reported readable, and the io_uring loop reads it asynchronously. */
+        if ((thread_ctx->wake_up_pipe_fd[0] = eventfd(0, EFD_CLOEXEC)) < 0) {
+            *ret = errno;
+        }
+        else
+        {
+            thread_ctx->wake_up_pipe_fd[1] = thread_ctx->wake_up_pipe_fd[0];
+            thread_ctx->wake_up_is_eventfd = 1;
+            thread_ctx->wake_up_defined = 1;
+        }
+    }
+    else
+#endif
     if (pipe(thread_ctx->wake_up_pipe_fd) != 0) {
         *ret = errno;
     }
@@ -1229,8 +2912,15 @@ picoquic_network_thread_ctx_t* picoquic_start_custom_network_thread(picoquic_qui
         thread_ctx->loop_callback_ctx = loop_callback_ctx;
         /* Open the wake up pipe or event */
         picoquic_open_network_wake_up(thread_ctx, ret);
+        /* Start the metrics endpoint before the network thread uses the context */
+        if (thread_ctx->wake_up_defined && param->metrics_port != 0 &&
+            (thread_ctx->metrics_server = picoquic_start_metrics_server(quic, param->metrics_port,
+                param->metrics_bind_any, ret)) == NULL) {
+            picoquic_delete_network_thread(thread_ctx);
+            thread_ctx = NULL;
+        }
         /* Start thread at specified entry point */
-        if (thread_ctx->wake_up_defined){
+        else if (thread_ctx->wake_up_defined){
             thread_ctx->is_threaded = 1;
             if (thread_create_fn == NULL) {
                 thread_create_fn = picoquic_internal_thread_create;
@@ -1242,7 +2932,13 @@ picoquic_network_thread_ctx_t* picoquic_start_custom_network_thread(picoquic_qui
                 thread_ctx->thread_delete_fn = picoquic_internal_thread_delete;
             }
             thread_ctx->thread_name = thread_name;
-            if ((*ret = thread_create_fn((void **)&thread_ctx->pthread, picoquic_packet_loop_v3, (void*)thread_ctx)) != 0) {
+            if ((*ret = thread_create_fn((void **)&thread_ctx->pthread,
+#ifdef _WINDOWS
+                (param->use_rio) ? picoquic_packet_loop_rio :
+#else
+                (param->use_io_uring) ? picoquic_packet_loop_uring :
+#endif
+                picoquic_packet_loop_v3, (void*)thread_ctx)) != 0) {
                 /* Free the context and return error condition if something went wrong */
                 thread_ctx->is_threaded = 0;
                 picoquic_delete_network_thread(thread_ctx);
@@ -1271,14 +2967,34 @@ int picoquic_wake_up_network_thread(picoquic_network_thread_ctx_t* thread_ctx)
             ret = (int)err;
         }
 #else
-        /* TODO: write to network pipe */
-        ssize_t written = 0;
-        if ((written = write(thread_ctx->wake_up_pipe_fd[1], &ret, 1)) != 1) {
-            if (written == 0) {
-                ret = EPIPE;
+        const picoquic_packet_io_provider_t* io_provider = (thread_ctx->param == NULL) ? NULL : thread_ctx->param->io_provider;
+
+        if (io_provider != NULL && io_provider->wake != NULL) {
+            /* The provider does not wait on the pipe. The request is retrieved
+             * by the loop after the next call to wait. */
+            void* io_ctx = thread_ctx->io_ctx;
+            __atomic_store_n(&thread_ctx->io_wake_up_requested, 1, __ATOMIC_RELEASE);
+            if (io_ctx != NULL) {
+                io_provider->wake(io_ctx);
+            }
+        }
+        else {
+            if (thread_ctx->wake_up_is_eventfd) {
+                uint64_t one = 1;
+                if (write(thread_ctx->wake_up_pipe_fd[1], &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+                    ret = errno;
+                }
             }
             else {
-                ret = errno;
+                ssize_t written = 0;
+                if ((written = write(thread_ctx->wake_up_pipe_fd[1], &ret, 1)) != 1) {
+                    if (written == 0) {
+                        ret = EPIPE;
+                    }
+                    else {
+                        ret = errno;
+                    }
+                }
             }
         }
 #endif
@@ -1290,19 +3006,405 @@ int picoquic_wake_up_network_thread(picoquic_network_thread_ctx_t* thread_ctx)
     return ret;
 }
 
+/* Commands posted to the network thread. The queue is a lock free stack:
+ * producers push commands with a compare and swap on the head, and the
+ * network thread takes the whole list with an atomic exchange, then
+ * reverses it to execute the commands in posting order. */
+static int picoquic_network_command_push(picoquic_network_command_t* volatile* head,
+    picoquic_network_command_t* expected, picoquic_network_command_t* command)
+{
+#ifdef _WINDOWS
+    return InterlockedCompareExchangePointer((PVOID volatile*)head, (PVOID)command, (PVOID)expected) == (PVOID)expected;
+#else
+    return __atomic_compare_exchange_n(head, &expected, command, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#endif
+}
+
+static picoquic_network_command_t* picoquic_network_command_take_all(picoquic_network_thread_ctx_t* thread_ctx)
+{
+#ifdef _WINDOWS
+    return (picoquic_network_command_t*)InterlockedExchangePointer((PVOID volatile*)&thread_ctx->command_head, NULL);
+#else
+    return __atomic_exchange_n(&thread_ctx->command_head, NULL, __ATOMIC_ACQUIRE);
+#endif
+}
+
 void picoquic_delete_network_thread(picoquic_network_thread_ctx_t* thread_ctx)
 {
+    picoquic_network_command_t* command;
+
     /* set the should_close flag, so the thread knows the loop should stop */
     thread_ctx->thread_should_close = 1;
-    /* Delete the wake up event. This ought to create a fault 
-     * in the wait for event call, causing the thread to wake up,
-     * notice the flag, and exit.
-     */
-    picoquic_close_network_wake_up(thread_ctx);
+#ifndef _WINDOWS
+    if (thread_ctx->wake_up_is_eventfd) {
+        /* Closing an eventfd does not wake up a thread waiting on it. Signal
+         * it instead, and only close it after the thread has exited. */
+        if (thread_ctx->wake_up_defined) {
+            (void)picoquic_wake_up_network_thread(thread_ctx);
+        }
+    }
+    else
+#endif
+    {
+        /* Delete the wake up event. This ought to create a fault
+         * in the wait for event call, causing the thread to wake up,
+         * notice the flag, and exit.
+         */
+        picoquic_close_network_wake_up(thread_ctx);
+    }
     /* delete the thread */
     if (thread_ctx->is_threaded) {
         thread_ctx->thread_delete_fn((void**)&thread_ctx->pthread);
     }
+    /* Close the eventfd, if it was kept open while the thread exited */
+    picoquic_close_network_wake_up(thread_ctx);
+    picoquic_stop_metrics_server(thread_ctx->metrics_server);
+    /* Free the commands that were not executed */
+    command = picoquic_network_command_take_all(thread_ctx);
+    while (command != NULL) {
+        picoquic_network_command_t* next = command->next;
+        free(command);
+        command = next;
+    }
     /* Free the context */
     free(thread_ctx);
-}
\ No newline at end of file
+}
+
+picoquic_network_command_t* picoquic_create_network_command(picoquic_network_command_enum command_type,
+    picoquic_cnx_t* cnx, size_t data_length)
+{
+    picoquic_network_command_t* command = (picoquic_network_command_t*)malloc(sizeof(picoquic_network_command_t) + data_length);
+
+    if (command != NULL) {
+        memset(command, 0, sizeof(picoquic_network_command_t));
+        command->command_type = command_type;
+        command->cnx = cnx;
+        command->length = data_length;
+        command->data = (uint8_t*)(command + 1);
+    }
+    return command;
+}
+
+int picoquic_post_network_command(picoquic_network_thread_ctx_t* thread_ctx, picoquic_network_command_t* command)
+{
+    int ret = 0;
+    picoquic_network_command_t* head;
+
+    do {
+        head = thread_ctx->command_head;
+        command->next = head;
+    } while (!picoquic_network_command_push(&thread_ctx->command_head, head, command));
+
+    if (head == NULL) {
+        /* The queue was empty, so no wake up is pending yet */
+        ret = picoquic_wake_up_network_thread(thread_ctx);
+    }
+    return ret;
+}
+
+int picoquic_post_add_to_stream(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx,
+    uint64_t stream_id, const uint8_t* data, size_t length, int set_fin)
+{
+    int ret = -1;
+    picoquic_network_command_t* command = picoquic_create_network_command(picoquic_network_command_add_to_stream,
+        cnx, length);
+
+    if (command != NULL) {
+        command->stream_id = stream_id;
+        command->value = (set_fin) ? 1 : 0;
+        if (length > 0) {
+            memcpy(command->data, data, length);
+        }
+        ret = picoquic_post_network_command(thread_ctx, command);
+    }
+    return ret;
+}
+
+int picoquic_post_mark_active_stream(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx,
+    uint64_t stream_id, int is_active, void* v_stream_ctx)
+{
+    int ret = -1;
+    picoquic_network_command_t* command = picoquic_create_network_command(picoquic_network_command_mark_active_stream,
+        cnx, 0);
+
+    if (command != NULL) {
+        command->stream_id = stream_id;
+        command->value = (is_active) ? 1 : 0;
+        command->app_ctx = v_stream_ctx;
+        ret = picoquic_post_network_command(thread_ctx, command);
+    }
+    return ret;
+}
+
+int picoquic_post_mark_datagram_ready(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx, int is_ready)
+{
+    int ret = -1;
+    picoquic_network_command_t* command = picoquic_create_network_command(picoquic_network_command_mark_datagram_ready,
+        cnx, 0);
+
+    if (command != NULL) {
+        command->value = (is_ready) ? 1 : 0;
+        ret = picoquic_post_network_command(thread_ctx, command);
+    }
+    return ret;
+}
+
+int picoquic_post_datagram_to_ring(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx,
+    const uint8_t* data, size_t length, uint8_t priority, uint64_t expiry_time)
+{
+    int ret = -1;
+    picoquic_network_command_t* command = picoquic_create_network_command(picoquic_network_command_queue_datagram,
+        cnx, length);
+
+    if (command != NULL) {
+        command->stream_id = priority;
+        command->value = expiry_time;
+        if (length > 0) {
+            memcpy(command->data, data, length);
+        }
+        ret = picoquic_post_network_command(thread_ctx, command);
+    }
+    return ret;
+}
+
+int picoquic_post_close(picoquic_network_thread_ctx_t* thread_ctx, picoquic_cnx_t* cnx, uint64_t application_reason_code)
+{
+    int ret = -1;
+    picoquic_network_command_t* command = picoquic_create_network_command(picoquic_network_command_close,
+        cnx, 0);
+
+    if (command != NULL) {
+        command->value = application_reason_code;
+        ret = picoquic_post_network_command(thread_ctx, command);
+    }
+    return ret;
+}
+
+int picoquic_post_network_callback(picoquic_network_thread_ctx_t* thread_ctx,
+    picoquic_network_command_fn command_fn, void* app_ctx)
+{
+    int ret = -1;
+    picoquic_network_command_t* command = picoquic_create_network_command(picoquic_network_command_callback,
+        NULL, 0);
+
+    if (command != NULL) {
+        command->command_fn = command_fn;
+        command->app_ctx = app_ctx;
+        ret = picoquic_post_network_command(thread_ctx, command);
+    }
+    return ret;
+}
+
+void picoquic_run_network_commands(picoquic_network_thread_ctx_t* thread_ctx)
+{
+    picoquic_network_command_t* list = picoquic_network_command_take_all(thread_ctx);
+    picoquic_network_command_t* command = NULL;
+
+    /* The list is in reverse posting order */
+    while (list != NULL) {
+        picoquic_network_command_t* next = list->next;
+        list->next = command;
+        command = list;
+        list = next;
+    }
+
+    while (command != NULL) {
+        picoquic_network_command_t* next = command->next;
+        int ret = 0;
+
+        switch (command->command_type) {
+        case picoquic_network_command_add_to_stream:
+            ret = picoquic_add_to_stream(command->cnx, command->stream_id, command->data, command->length,
+                (int)command->value);
+            break;
+        case picoquic_network_command_mark_active_stream:
+            ret = picoquic_mark_active_stream(command->cnx, command->stream_id, (int)command->value,
+                command->app_ctx);
+            break;
+        case picoquic_network_command_mark_datagram_ready:
+            ret = picoquic_mark_datagram_ready(command->cnx, (int)command->value);
+            break;
+        case picoquic_network_command_close:
+            ret = picoquic_close(command->cnx, command->value);
+            break;
+        case picoquic_network_command_callback:
+            if (command->command_fn != NULL) {
+                command->command_fn(thread_ctx->quic, command->app_ctx);
+            }
+            break;
+        case picoquic_network_command_queue_datagram:
+            ret = picoquic_queue_datagram_to_ring(command->cnx, command->data, command->length,
+                (uint8_t)command->stream_id, command->value);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+        if (ret != 0) {
+            DBG_PRINTF("Network command %d returns 0x%x", (int)command->command_type, ret);
+        }
+        free(command);
+        command = next;
+    }
+}
+/* Configure the CID generation of a shard, so that the second byte of
+ * each CID carries the shard index. */
+static int picoquic_sharded_server_config_cid(picoquic_quic_t* quic, int shard_id)
+{
+    picoquic_load_balancer_config_t lb_config;
+
+    memset(&lb_config, 0, sizeof(lb_config));
+    lb_config.method = picoquic_load_balancer_cid_clear;
+    lb_config.server_id_length = 1;
+    lb_config.connection_id_length = quic->local_cnxid_length;
+    lb_config.server_id64 = (uint64_t)shard_id;
+
+    return picoquic_lb_compat_cid_config(quic, &lb_config);
+}
+
+void picoquic_delete_sharded_server(picoquic_sharded_server_t* sharded_server)
+{
+    if (sharded_server != NULL) {
+        for (int i = 0; i < sharded_server->nb_shards; i++) {
+            if (sharded_server->thread_ctx != NULL && sharded_server->thread_ctx[i] != NULL) {
+                picoquic_delete_network_thread(sharded_server->thread_ctx[i]);
+            }
+        }
+        for (int i = 0; i < sharded_server->nb_shards; i++) {
+            if (sharded_server->quic != NULL && sharded_server->quic[i] != NULL) {
+                picoquic_lb_compat_cid_config_free(sharded_server->quic[i]);
+                picoquic_free(sharded_server->quic[i]);
+            }
+        }
+#ifndef _WINDOWS
+        /* The shards send on the dispatcher sockets, which are only closed after the shards stop. */
+        picoquic_delete_dispatcher(sharded_server->dispatcher);
+#endif
+        if (sharded_server->worker_param != NULL) {
+            free(sharded_server->worker_param);
+        }
+        if (sharded_server->thread_ctx != NULL) {
+            free(sharded_server->thread_ctx);
+        }
+        if (sharded_server->quic != NULL) {
+            free(sharded_server->quic);
+        }
+        if (sharded_server->param != NULL) {
+            free(sharded_server->param);
+        }
+        free(sharded_server);
+    }
+}
+
+picoquic_quic_t* picoquic_quic_group_shard_create(int shard_id, void* quic_create_ctx)
+{
+    return picoquic_quic_group_release_shard((picoquic_quic_group_t*)quic_create_ctx, shard_id);
+}
+
+picoquic_sharded_server_t* picoquic_start_sharded_server(int nb_shards,
+    picoquic_packet_loop_param_t* param,
+    picoquic_shard_quic_create_fn quic_create_fn,
+    void* quic_create_ctx,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void** loop_callback_ctx,
+    int* ret)
+{
+    picoquic_sharded_server_t* sharded_server = NULL;
+
+    *ret = 0;
+    if (nb_shards <= 0 || nb_shards > PICOQUIC_SHARDS_MAX || quic_create_fn == NULL ||
+        (param->local_port == 0 && !param->use_dispatcher)) {
+        DBG_PRINTF("Invalid sharded server parameters, nb_shards=%d, port=%d", nb_shards, param->local_port);
+        *ret = -1;
+    }
+    else if ((sharded_server = (picoquic_sharded_server_t*)malloc(sizeof(picoquic_sharded_server_t))) == NULL) {
+        *ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(sharded_server, 0, sizeof(picoquic_sharded_server_t));
+        sharded_server->nb_shards = nb_shards;
+        sharded_server->quic = (picoquic_quic_t**)malloc(nb_shards * sizeof(picoquic_quic_t*));
+        sharded_server->param = (picoquic_packet_loop_param_t*)malloc(nb_shards * sizeof(picoquic_packet_loop_param_t));
+        sharded_server->thread_ctx = (picoquic_network_thread_ctx_t**)malloc(nb_shards * sizeof(picoquic_network_thread_ctx_t*));
+        if (sharded_server->quic == NULL || sharded_server->param == NULL || sharded_server->thread_ctx == NULL) {
+            *ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(sharded_server->quic, 0, nb_shards * sizeof(picoquic_quic_t*));
+            memset(sharded_server->thread_ctx, 0, nb_shards * sizeof(picoquic_network_thread_ctx_t*));
+        }
+        if (*ret == 0 && param->use_dispatcher) {
+#ifdef _WINDOWS
+            DBG_PRINTF("%s", "The dispatcher is not supported on Windows");
+            *ret = -1;
+#else
+            if ((sharded_server->worker_param = (picoquic_dispatch_worker_param_t*)malloc(
+                nb_shards * sizeof(picoquic_dispatch_worker_param_t))) == NULL) {
+                *ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                sharded_server->dispatcher = picoquic_start_dispatcher(param, nb_shards, ret);
+            }
+#endif
+        }
+        for (int i = 0; *ret == 0 && i < nb_shards; i++) {
+            if ((sharded_server->quic[i] = quic_create_fn(i, quic_create_ctx)) == NULL) {
+                DBG_PRINTF("Cannot create the QUIC context of shard %d", i);
+                *ret = -1;
+            }
+            else if (sharded_server->quic[i]->local_cnxid_length < 2 ||
+                picoquic_sharded_server_config_cid(sharded_server->quic[i], i) != 0) {
+                DBG_PRINTF("Cannot configure the CID of shard %d", i);
+                *ret = -1;
+            }
+            else {
+                picoquic_packet_loop_param_t* shard_param = &sharded_server->param[i];
+
+                memcpy(shard_param, param, sizeof(picoquic_packet_loop_param_t));
+                if (sharded_server->dispatcher != NULL) {
+#ifndef _WINDOWS
+                    /* The shard takes its packets from the dispatcher ring */
+                    (void)picoquic_dispatcher_worker_param(sharded_server->dispatcher, i, &sharded_server->worker_param[i]);
+                    shard_param->io_provider = &picoquic_dispatch_io_provider;
+                    shard_param->io_provider_param = &sharded_server->worker_param[i];
+#endif
+                }
+                else {
+                    shard_param->reuse_port = 1;
+                    /* The steering program applies to the whole group, it only needs to be attached once. */
+                    shard_param->reuseport_steering_shards = (i == 0) ? nb_shards : 0;
+                }
+                if (param->pin_to_cpu) {
+                    shard_param->cpu_index = param->cpu_index + i;
+                }
+                sharded_server->thread_ctx[i] = picoquic_start_network_thread(sharded_server->quic[i], shard_param,
+                    loop_callback, (loop_callback_ctx == NULL) ? NULL : loop_callback_ctx[i], ret);
+                if (sharded_server->thread_ctx[i] == NULL) {
+                    if (*ret == 0) {
+                        *ret = -1;
+                    }
+                }
+                else {
+                    /* Wait until the sockets are bound before starting the next shard,
+                     * so the rank of the sockets in the port group matches the shard index. */
+                    for (int t = 0; t < 2000 && !sharded_server->thread_ctx[i]->thread_is_ready; t++) {
+#ifdef _WINDOWS
+                        Sleep(1);
+#else
+                        usleep(1000);
+#endif
+                    }
+                    if (!sharded_server->thread_ctx[i]->thread_is_ready) {
+                        DBG_PRINTF("Cannot start the network thread of shard %d", i);
+                        *ret = -1;
+                    }
+                }
+            }
+        }
+        if (*ret != 0) {
+            picoquic_delete_sharded_server(sharded_server);
+            sharded_server = NULL;
+        }
+    }
+    return sharded_server;
+}
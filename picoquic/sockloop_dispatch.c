@@ -0,0 +1,665 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* Dispatcher mode of the socket loop.
+ *
+ * When several workers share a single UDP socket, for example in containers
+ * where SO_REUSEPORT is not available, a dispatcher thread owns the sockets
+ * and reads all the incoming datagrams. It finds the worker owning the
+ * connection from the destination CID, and pushes the datagram to the
+ * single producer, single consumer ring of that worker. Each worker runs
+ * picoquic_packet_loop_provider with picoquic_dispatch_io_provider, which
+ * takes the packets from its ring and sends directly on the shared sockets.
+ *
+ * The CIDs are expected to carry the worker index in their second byte, as
+ * set by the sharded server, see picoquic_start_sharded_server. Datagrams
+ * with shorter CIDs go to worker 0.
+ */
+
+#ifndef _WINDOWS
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "picosocks.h"
+#include "picoquic.h"
+#include "picoquic_internal.h"
+#include "picoquic_packet_loop.h"
+#include "picoquic_unified_log.h"
+
+#define PICOQUIC_DISPATCH_RECV_BUDGET 64
+#define PICOQUIC_DISPATCH_NB_SEND_BUFFERS PICOQUIC_PACKET_LOOP_SEND_MAX
+
+typedef struct st_picoquic_dispatch_slot_t {
+    size_t length;
+    struct sockaddr_storage addr_peer;
+    struct sockaddr_storage addr_local;
+    int if_index;
+    unsigned char ecn;
+    uint64_t receive_time;
+    uint8_t bytes[PICOQUIC_MAX_PACKET_SIZE];
+} picoquic_dispatch_slot_t;
+
+/* The head is only written by the dispatcher, the tail by the worker. They
+ * are kept on separate cache lines to avoid false sharing. */
+typedef struct st_picoquic_dispatch_ring_t {
+    volatile uint64_t head;
+    uint8_t head_padding[64 - sizeof(uint64_t)];
+    volatile uint64_t tail;
+    uint8_t tail_padding[64 - sizeof(uint64_t)];
+    volatile int is_waiting; /* Set by the worker before blocking */
+    int wake_fd[2]; /* Written by the dispatcher if the worker is waiting */
+    int is_open; /* A worker is attached to the ring */
+    uint64_t nb_dispatched;
+    uint64_t nb_dropped;
+    picoquic_dispatch_slot_t* slots;
+} picoquic_dispatch_ring_t;
+
+struct st_picoquic_dispatcher_t {
+    picoquic_packet_loop_param_t param;
+    picoquic_socket_ctx_t s_ctx[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    int nb_sockets;
+    int nb_workers;
+    picoquic_dispatch_ring_t* rings;
+    picoquic_thread_t thread;
+    int is_thread_started;
+    int stop_fd[2];
+    volatile int thread_should_close;
+    int return_code;
+    uint8_t recv_buffer[PICOQUIC_MAX_PACKET_SIZE];
+};
+
+/* Context of the I/O provider, one per worker. */
+typedef struct st_picoquic_dispatch_io_ctx_t {
+    picoquic_dispatcher_t* dispatcher;
+    picoquic_dispatch_ring_t* ring;
+    picoquic_packet_loop_param_t* param;
+    int wake_up_fd;
+    uint64_t next_read; /* Next slot returned by rx_burst, not yet released */
+    size_t buffer_size;
+    uint8_t* buffers;
+    int free_list[PICOQUIC_DISPATCH_NB_SEND_BUFFERS];
+    int nb_free;
+} picoquic_dispatch_io_ctx_t;
+
+/* Received packets are identified by the flag in the handle, with the
+ * index of the ring slot in the low order bits. */
+#define PICOQUIC_DISPATCH_RX_HANDLE 0x8000000000000000ull
+
+int picoquic_dispatch_worker_index(const uint8_t* bytes, size_t length, int nb_workers)
+{
+    int worker_id = 0;
+
+    if (nb_workers > 1) {
+        if ((bytes[0] & 0x80) == 0) {
+            /* Short header: the DCID starts at byte 1 */
+            if (length >= 3) {
+                worker_id = bytes[2] % nb_workers;
+            }
+        }
+        else if (length >= 8 && bytes[5] >= 2) {
+            /* Long header: the DCID length is at byte 5, the DCID starts at byte 6 */
+            worker_id = bytes[7] % nb_workers;
+        }
+    }
+    return worker_id;
+}
+
+static void picoquic_dispatch_close_fd_pair(int* fd)
+{
+    for (int i = 0; i < 2; i++) {
+        if (fd[i] >= 0) {
+            close(fd[i]);
+            fd[i] = -1;
+        }
+    }
+}
+
+static int picoquic_dispatch_open_fd_pair(int* fd)
+{
+    int ret = 0;
+
+    if (pipe(fd) != 0) {
+        fd[0] = -1;
+        fd[1] = -1;
+        ret = errno;
+    }
+    else {
+        for (int i = 0; i < 2; i++) {
+            int flags = fcntl(fd[i], F_GETFL, 0);
+            (void)fcntl(fd[i], F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+    return ret;
+}
+
+static void picoquic_dispatch_drain_fd(int fd)
+{
+    uint8_t eventbuf[64];
+
+    while (read(fd, eventbuf, sizeof(eventbuf)) > 0);
+}
+
+/* Copy the datagram in the next slot of the ring, or drop it if the ring is full. */
+static int picoquic_dispatch_push(picoquic_dispatch_ring_t* ring, const uint8_t* bytes, size_t length,
+    struct sockaddr_storage* addr_peer, struct sockaddr_storage* addr_local, int if_index,
+    unsigned char ecn, uint64_t receive_time)
+{
+    int ret = 0;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= PICOQUIC_DISPATCH_RING_SIZE) {
+        ring->nb_dropped++;
+        ret = -1;
+    }
+    else {
+        picoquic_dispatch_slot_t* slot = &ring->slots[head % PICOQUIC_DISPATCH_RING_SIZE];
+
+        memcpy(slot->bytes, bytes, length);
+        slot->length = length;
+        picoquic_store_addr(&slot->addr_peer, (struct sockaddr*)addr_peer);
+        picoquic_store_addr(&slot->addr_local, (struct sockaddr*)addr_local);
+        slot->if_index = if_index;
+        slot->ecn = ecn;
+        slot->receive_time = receive_time;
+        ring->nb_dispatched++;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
+
+/* Wake up the worker if it is blocked waiting for packets. */
+static void picoquic_dispatch_signal(picoquic_dispatch_ring_t* ring)
+{
+    if (__atomic_exchange_n(&ring->is_waiting, 0, __ATOMIC_SEQ_CST) != 0) {
+        uint8_t event = 1;
+        if (write(ring->wake_fd[1], &event, 1) < 0 && errno != EAGAIN) {
+            DBG_PRINTF("Cannot signal the dispatch ring, err=%d", errno);
+        }
+    }
+}
+
+/* Read the datagrams available on a socket and pass them to the workers. */
+static void picoquic_dispatch_receive(picoquic_dispatcher_t* dispatcher, picoquic_socket_ctx_t* s_ctx,
+    uint8_t* is_signaled)
+{
+    for (int n = 0; n < PICOQUIC_DISPATCH_RECV_BUDGET; n++) {
+        struct sockaddr_storage addr_peer;
+        struct sockaddr_storage addr_local;
+        int if_index = 0;
+        unsigned char ecn = 0;
+        uint64_t receive_time = 0;
+        int worker_id;
+        int bytes_recv;
+
+        memset(&addr_local, 0, sizeof(addr_local));
+        bytes_recv = picoquic_recvmsg_ex(s_ctx->fd, &addr_peer, &addr_local, &if_index, &ecn,
+            dispatcher->recv_buffer, (int)sizeof(dispatcher->recv_buffer), MSG_DONTWAIT,
+            NULL, (s_ctx->use_rx_timestamps) ? &receive_time : NULL);
+        if (bytes_recv <= 0) {
+            /* Drained, or error such as ICMP unreachable. */
+            break;
+        }
+        if (addr_local.ss_family == AF_INET6) {
+            ((struct sockaddr_in6*)&addr_local)->sin6_port = s_ctx->n_port;
+        }
+        else if (addr_local.ss_family == AF_INET) {
+            ((struct sockaddr_in*)&addr_local)->sin_port = s_ctx->n_port;
+        }
+        worker_id = picoquic_dispatch_worker_index(dispatcher->recv_buffer, (size_t)bytes_recv, dispatcher->nb_workers);
+        if (picoquic_dispatch_push(&dispatcher->rings[worker_id], dispatcher->recv_buffer, (size_t)bytes_recv,
+            &addr_peer, &addr_local, if_index, ecn, receive_time) == 0) {
+            is_signaled[worker_id] = 1;
+        }
+    }
+}
+
+static void* picoquic_dispatcher_thread(void* v_ctx)
+{
+    picoquic_dispatcher_t* dispatcher = (picoquic_dispatcher_t*)v_ctx;
+    uint8_t is_signaled[PICOQUIC_SHARDS_MAX];
+    int ret = 0;
+
+    picoquic_packet_loop_set_affinity(&dispatcher->param);
+
+    while (ret == 0 && !dispatcher->thread_should_close) {
+        fd_set readfds;
+        int sockmax = dispatcher->stop_fd[0];
+        int ret_select;
+
+        FD_ZERO(&readfds);
+        FD_SET(dispatcher->stop_fd[0], &readfds);
+        for (int i = 0; i < dispatcher->nb_sockets; i++) {
+            if (sockmax < (int)dispatcher->s_ctx[i].fd) {
+                sockmax = (int)dispatcher->s_ctx[i].fd;
+            }
+            FD_SET(dispatcher->s_ctx[i].fd, &readfds);
+        }
+
+        ret_select = select(sockmax + 1, &readfds, NULL, NULL, NULL);
+        if (ret_select < 0) {
+            if (errno != EINTR) {
+                DBG_PRINTF("Error: dispatcher select returns %d, err=%d\n", ret_select, errno);
+                ret = -1;
+            }
+        }
+        else if (ret_select > 0) {
+            memset(is_signaled, 0, dispatcher->nb_workers);
+            for (int i = 0; i < dispatcher->nb_sockets; i++) {
+                if (FD_ISSET(dispatcher->s_ctx[i].fd, &readfds)) {
+                    picoquic_dispatch_receive(dispatcher, &dispatcher->s_ctx[i], is_signaled);
+                }
+            }
+            /* Signal each worker once per batch */
+            for (int i = 0; i < dispatcher->nb_workers; i++) {
+                if (is_signaled[i]) {
+                    picoquic_dispatch_signal(&dispatcher->rings[i]);
+                }
+            }
+        }
+    }
+    dispatcher->return_code = ret;
+    return NULL;
+}
+
+void picoquic_delete_dispatcher(picoquic_dispatcher_t* dispatcher)
+{
+    if (dispatcher != NULL) {
+        if (dispatcher->is_thread_started) {
+            uint8_t event = 1;
+            dispatcher->thread_should_close = 1;
+            if (write(dispatcher->stop_fd[1], &event, 1) < 0) {
+                DBG_PRINTF("Cannot signal the dispatcher thread, err=%d", errno);
+            }
+            picoquic_delete_thread(&dispatcher->thread);
+        }
+        picoquic_dispatch_close_fd_pair(dispatcher->stop_fd);
+        for (int i = 0; i < dispatcher->nb_sockets; i++) {
+            picoquic_packet_loop_close_socket(&dispatcher->s_ctx[i]);
+        }
+        if (dispatcher->rings != NULL) {
+            for (int i = 0; i < dispatcher->nb_workers; i++) {
+                picoquic_dispatch_close_fd_pair(dispatcher->rings[i].wake_fd);
+                if (dispatcher->rings[i].slots != NULL) {
+                    free(dispatcher->rings[i].slots);
+                }
+            }
+            free(dispatcher->rings);
+        }
+        free(dispatcher);
+    }
+}
+
+picoquic_dispatcher_t* picoquic_start_dispatcher(picoquic_packet_loop_param_t* param, int nb_workers, int* ret)
+{
+    picoquic_dispatcher_t* dispatcher = NULL;
+
+    *ret = 0;
+    if (nb_workers <= 0 || nb_workers > PICOQUIC_SHARDS_MAX) {
+        DBG_PRINTF("Invalid dispatcher parameters, nb_workers=%d", nb_workers);
+        *ret = -1;
+    }
+    else if ((dispatcher = (picoquic_dispatcher_t*)malloc(sizeof(picoquic_dispatcher_t))) == NULL) {
+        *ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(dispatcher, 0, sizeof(picoquic_dispatcher_t));
+        memcpy(&dispatcher->param, param, sizeof(picoquic_packet_loop_param_t));
+        dispatcher->nb_workers = nb_workers;
+        dispatcher->stop_fd[0] = -1;
+        dispatcher->stop_fd[1] = -1;
+        if ((dispatcher->rings = (picoquic_dispatch_ring_t*)malloc(nb_workers * sizeof(picoquic_dispatch_ring_t))) == NULL) {
+            *ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(dispatcher->rings, 0, nb_workers * sizeof(picoquic_dispatch_ring_t));
+            for (int i = 0; i < nb_workers; i++) {
+                dispatcher->rings[i].wake_fd[0] = -1;
+                dispatcher->rings[i].wake_fd[1] = -1;
+            }
+            for (int i = 0; *ret == 0 && i < nb_workers; i++) {
+                if ((dispatcher->rings[i].slots = (picoquic_dispatch_slot_t*)malloc(
+                    PICOQUIC_DISPATCH_RING_SIZE * sizeof(picoquic_dispatch_slot_t))) == NULL) {
+                    *ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    *ret = picoquic_dispatch_open_fd_pair(dispatcher->rings[i].wake_fd);
+                }
+            }
+        }
+        if (*ret == 0) {
+            *ret = picoquic_dispatch_open_fd_pair(dispatcher->stop_fd);
+        }
+        if (*ret == 0) {
+            for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+                dispatcher->s_ctx[i].use_rx_timestamps = (param->use_receive_timestamps) ? 1 : 0;
+            }
+            if ((dispatcher->nb_sockets = picoquic_packet_loop_open_sockets(param->local_port,
+                param->local_af, param->socket_buffer_size,
+                param->extra_socket_required, param->do_not_use_gso, dispatcher->s_ctx)) <= 0) {
+                DBG_PRINTF("Cannot open the dispatcher sockets, port=%d", param->local_port);
+                dispatcher->nb_sockets = 0;
+                *ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+            }
+            else {
+                if ((*ret = picoquic_create_thread(&dispatcher->thread, picoquic_dispatcher_thread, dispatcher)) == 0) {
+                    dispatcher->is_thread_started = 1;
+                }
+                else {
+                    DBG_PRINTF("Cannot start the dispatcher thread, ret=%d", *ret);
+                }
+            }
+        }
+        if (*ret != 0) {
+            picoquic_delete_dispatcher(dispatcher);
+            dispatcher = NULL;
+        }
+    }
+    return dispatcher;
+}
+
+uint16_t picoquic_dispatcher_port(picoquic_dispatcher_t* dispatcher)
+{
+    return (dispatcher->nb_sockets > 0) ? dispatcher->s_ctx[0].port : 0;
+}
+
+int picoquic_dispatcher_worker_param(picoquic_dispatcher_t* dispatcher, int worker_id,
+    picoquic_dispatch_worker_param_t* worker_param)
+{
+    int ret = 0;
+
+    if (worker_id < 0 || worker_id >= dispatcher->nb_workers) {
+        ret = -1;
+    }
+    else {
+        worker_param->dispatcher = dispatcher;
+        worker_param->worker_id = worker_id;
+    }
+    return ret;
+}
+
+void picoquic_get_dispatcher_stats(picoquic_dispatcher_t* dispatcher, int worker_id,
+    uint64_t* nb_dispatched, uint64_t* nb_dropped)
+{
+    *nb_dispatched = 0;
+    *nb_dropped = 0;
+    if (worker_id >= 0 && worker_id < dispatcher->nb_workers) {
+        *nb_dispatched = dispatcher->rings[worker_id].nb_dispatched;
+        *nb_dropped = dispatcher->rings[worker_id].nb_dropped;
+    }
+}
+
+/* Implementation of the packet I/O provider for the workers.
+ */
+static void picoquic_dispatch_io_close(void* io_ctx)
+{
+    picoquic_dispatch_io_ctx_t* dispatch_io = (picoquic_dispatch_io_ctx_t*)io_ctx;
+
+    if (dispatch_io != NULL) {
+        if (dispatch_io->ring != NULL) {
+            /* Packets received but not released are dropped */
+            __atomic_store_n(&dispatch_io->ring->tail, dispatch_io->ring->head, __ATOMIC_RELEASE);
+            dispatch_io->ring->is_open = 0;
+        }
+        if (dispatch_io->buffers != NULL) {
+            free(dispatch_io->buffers);
+        }
+        free(dispatch_io);
+    }
+}
+
+static int picoquic_dispatch_io_open(picoquic_packet_loop_param_t* param, void* provider_param, int wake_up_fd,
+    void** io_ctx, struct sockaddr_storage* local_addr)
+{
+    int ret = 0;
+    picoquic_dispatch_worker_param_t* worker_param = (picoquic_dispatch_worker_param_t*)provider_param;
+    picoquic_dispatch_io_ctx_t* dispatch_io = NULL;
+
+    *io_ctx = NULL;
+    if (worker_param == NULL || worker_param->dispatcher == NULL ||
+        worker_param->worker_id < 0 || worker_param->worker_id >= worker_param->dispatcher->nb_workers ||
+        worker_param->dispatcher->rings[worker_param->worker_id].is_open) {
+        /* The ring has a single consumer */
+        ret = -1;
+    }
+    else if ((dispatch_io = (picoquic_dispatch_io_ctx_t*)malloc(sizeof(picoquic_dispatch_io_ctx_t))) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        picoquic_dispatcher_t* dispatcher = worker_param->dispatcher;
+
+        memset(dispatch_io, 0, sizeof(picoquic_dispatch_io_ctx_t));
+        dispatch_io->dispatcher = dispatcher;
+        dispatch_io->param = param;
+        dispatch_io->wake_up_fd = wake_up_fd;
+        dispatch_io->buffer_size = (param->do_not_use_gso) ? PICOQUIC_MAX_JUMBO_PACKET_SIZE : 0xFFFF;
+        if ((dispatch_io->buffers = (uint8_t*)malloc(dispatch_io->buffer_size * PICOQUIC_DISPATCH_NB_SEND_BUFFERS)) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+            picoquic_dispatch_io_close(dispatch_io);
+        }
+        else {
+            for (int i = 0; i < PICOQUIC_DISPATCH_NB_SEND_BUFFERS; i++) {
+                dispatch_io->free_list[i] = i;
+            }
+            dispatch_io->nb_free = PICOQUIC_DISPATCH_NB_SEND_BUFFERS;
+            dispatch_io->ring = &dispatcher->rings[worker_param->worker_id];
+            dispatch_io->ring->is_open = 1;
+            dispatch_io->next_read = __atomic_load_n(&dispatch_io->ring->tail, __ATOMIC_ACQUIRE);
+            if (dispatcher->nb_sockets > 0) {
+                (void)picoquic_store_loopback_addr(local_addr, dispatcher->s_ctx[0].af, dispatcher->s_ctx[0].port);
+            }
+            *io_ctx = dispatch_io;
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_dispatch_io_get_buffer(void* io_ctx, picoquic_packet_io_t* packet)
+{
+    int ret = 0;
+    picoquic_dispatch_io_ctx_t* dispatch_io = (picoquic_dispatch_io_ctx_t*)io_ctx;
+
+    if (dispatch_io->nb_free <= 0) {
+        ret = -1;
+    }
+    else {
+        int index = dispatch_io->free_list[--dispatch_io->nb_free];
+        packet->bytes = dispatch_io->buffers + (size_t)index * dispatch_io->buffer_size;
+        packet->buffer_size = dispatch_io->buffer_size;
+        packet->length = 0;
+        packet->handle = (uint64_t)index;
+    }
+    return ret;
+}
+
+static void picoquic_dispatch_io_release_buffer(void* io_ctx, picoquic_packet_io_t* packet)
+{
+    picoquic_dispatch_io_ctx_t* dispatch_io = (picoquic_dispatch_io_ctx_t*)io_ctx;
+
+    if ((packet->handle & PICOQUIC_DISPATCH_RX_HANDLE) != 0) {
+        /* The packets are released in the order in which they were received,
+         * so releasing one frees all the slots up to it. */
+        uint64_t position = (packet->handle & ~PICOQUIC_DISPATCH_RX_HANDLE) + 1;
+        if (position > dispatch_io->ring->tail) {
+            __atomic_store_n(&dispatch_io->ring->tail, position, __ATOMIC_RELEASE);
+        }
+    }
+    else if (packet->handle < PICOQUIC_DISPATCH_NB_SEND_BUFFERS && dispatch_io->nb_free < PICOQUIC_DISPATCH_NB_SEND_BUFFERS) {
+        dispatch_io->free_list[dispatch_io->nb_free++] = (int)packet->handle;
+    }
+    packet->bytes = NULL;
+}
+
+static int picoquic_dispatch_io_rx_burst(void* io_ctx, picoquic_packet_io_t* packets, int nb_max)
+{
+    picoquic_dispatch_io_ctx_t* dispatch_io = (picoquic_dispatch_io_ctx_t*)io_ctx;
+    picoquic_dispatch_ring_t* ring = dispatch_io->ring;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    int nb_received = 0;
+
+    /* The packets point to the ring slots, which stay reserved until released */
+    while (nb_received < nb_max && dispatch_io->next_read < head) {
+        picoquic_packet_io_t* packet = &packets[nb_received];
+        picoquic_dispatch_slot_t* slot = &ring->slots[dispatch_io->next_read % PICOQUIC_DISPATCH_RING_SIZE];
+
+        packet->bytes = slot->bytes;
+        packet->length = slot->length;
+        packet->buffer_size = sizeof(slot->bytes);
+        packet->send_msg_size = 0;
+        picoquic_store_addr(&packet->addr_peer, (struct sockaddr*)&slot->addr_peer);
+        picoquic_store_addr(&packet->addr_local, (struct sockaddr*)&slot->addr_local);
+        packet->if_index = slot->if_index;
+        packet->ecn = slot->ecn;
+        packet->receive_time = slot->receive_time;
+        packet->handle = dispatch_io->next_read | PICOQUIC_DISPATCH_RX_HANDLE;
+        dispatch_io->next_read++;
+        nb_received++;
+    }
+
+    return nb_received;
+}
+
+static int picoquic_dispatch_io_tx_burst(void* io_ctx, picoquic_packet_io_t* packets, int nb_packets, int* sock_err)
+{
+    picoquic_dispatch_io_ctx_t* dispatch_io = (picoquic_dispatch_io_ctx_t*)io_ctx;
+    picoquic_dispatcher_t* dispatcher = dispatch_io->dispatcher;
+    int nb_sent = 0;
+
+    /* The workers send directly on the shared sockets */
+    *sock_err = 0;
+    while (nb_sent < nb_packets) {
+        picoquic_packet_io_t* packet = &packets[nb_sent];
+        SOCKET_TYPE fd = picoquic_packet_loop_get_send_socket(dispatcher->s_ctx, dispatcher->nb_sockets,
+            dispatch_io->param, &packet->addr_peer, &packet->addr_local);
+        int sock_ret;
+
+        if (fd == INVALID_SOCKET) {
+            *sock_err = EAFNOSUPPORT;
+            break;
+        }
+        sock_ret = picoquic_sendmsg(fd, (struct sockaddr*)&packet->addr_peer, (struct sockaddr*)&packet->addr_local,
+            packet->if_index, (const char*)packet->bytes, (int)packet->length, (int)packet->send_msg_size, sock_err);
+        if (sock_ret <= 0) {
+            break;
+        }
+        picoquic_dispatch_io_release_buffer(io_ctx, packet);
+        nb_sent++;
+    }
+
+    return nb_sent;
+}
+
+static int picoquic_dispatch_io_wait(void* io_ctx, int64_t delta_t, int* is_wake_up)
+{
+    picoquic_dispatch_io_ctx_t* dispatch_io = (picoquic_dispatch_io_ctx_t*)io_ctx;
+    picoquic_dispatch_ring_t* ring = dispatch_io->ring;
+    fd_set readfds;
+    struct timeval tv;
+    int ret_select = 0;
+    int ret = 0;
+    int sockmax = ring->wake_fd[0];
+    int is_ready = 0;
+
+    *is_wake_up = 0;
+    if (dispatch_io->next_read < __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        is_ready = 1;
+    }
+    else {
+        /* Announce the wait, then check again, so that a packet pushed
+         * in between either is seen here or causes a signal. */
+        __atomic_store_n(&ring->is_waiting, 1, __ATOMIC_SEQ_CST);
+        if (dispatch_io->next_read < __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+            is_ready = 1;
+        }
+    }
+    if (is_ready) {
+        delta_t = 0;
+    }
+
+    FD_ZERO(&readfds);
+    FD_SET(ring->wake_fd[0], &readfds);
+    if (dispatch_io->wake_up_fd >= 0) {
+        if (sockmax < dispatch_io->wake_up_fd) {
+            sockmax = dispatch_io->wake_up_fd;
+        }
+        FD_SET(dispatch_io->wake_up_fd, &readfds);
+    }
+
+    if (delta_t <= 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+    }
+    else if (delta_t > 10000000) {
+        tv.tv_sec = (long)10;
+        tv.tv_usec = 0;
+    }
+    else {
+        tv.tv_sec = (long)(delta_t / 1000000);
+        tv.tv_usec = (long)(delta_t % 1000000);
+    }
+
+    ret_select = select(sockmax + 1, &readfds, NULL, NULL, &tv);
+    __atomic_store_n(&ring->is_waiting, 0, __ATOMIC_SEQ_CST);
+
+    if (ret_select < 0) {
+        if (errno != EINTR) {
+            ret = -1;
+            DBG_PRINTF("Error: select returns %d, err=%d\n", ret_select, errno);
+        }
+    }
+    else {
+        if (ret_select > 0) {
+            if (dispatch_io->wake_up_fd >= 0 && FD_ISSET(dispatch_io->wake_up_fd, &readfds)) {
+                *is_wake_up = 1;
+            }
+            if (FD_ISSET(ring->wake_fd[0], &readfds)) {
+                picoquic_dispatch_drain_fd(ring->wake_fd[0]);
+            }
+        }
+        ret = (dispatch_io->next_read < __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) ? 1 : 0;
+    }
+
+    return ret;
+}
+
+const picoquic_packet_io_provider_t picoquic_dispatch_io_provider = {
+    "dispatch",
+    picoquic_dispatch_io_open,
+    picoquic_dispatch_io_close,
+    picoquic_dispatch_io_rx_burst,
+    picoquic_dispatch_io_tx_burst,
+    picoquic_dispatch_io_get_buffer,
+    picoquic_dispatch_io_release_buffer,
+    picoquic_dispatch_io_wait,
+    NULL,
+    1
+};
+#endif
@@ -0,0 +1,552 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Variant of the socket loop using a packet I/O provider.
+ *
+ * The loop sends and receives packets through the functions of the provider
+ * specified in param->io_provider, see picoquic_packet_io_provider_t in
+ * picoquic_packet_loop.h. This allows running the stack over frameworks that
+ * bypass the kernel sockets, such as AF_XDP or DPDK. Each iteration waits for
+ * incoming packets or for the next wake up time, processes a burst of incoming
+ * packets, and then prepares a burst of outgoing packets directly in the send
+ * buffers of the provider.
+ *
+ * The file also provides picoquic_socket_io_provider, an implementation
+ * of the interface based on the UDP sockets of picoquic_packet_loop_v3. It is
+ * mostly useful for testing the provider loop, and as an example. Applications
+ * using sockets should use the default loop, which supports batching, GSO,
+ * zero copy and other optimizations.
+ */
+
+#ifndef _WINDOWS
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "picosocks.h"
+#include "picoquic.h"
+#include "picoquic_internal.h"
+#include "picoquic_packet_loop.h"
+#include "picoquic_unified_log.h"
+
+#define PICOQUIC_SOCK_IO_NB_BUFFERS (PICOQUIC_PACKET_LOOP_RECV_MAX + PICOQUIC_PACKET_LOOP_SEND_MAX)
+
+typedef struct st_picoquic_sock_io_ctx_t {
+    picoquic_packet_loop_param_t* param;
+    picoquic_socket_ctx_t s_ctx[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    int nb_sockets;
+    int next_rank;
+    int wake_up_fd;
+    size_t buffer_size;
+    uint8_t* buffers;
+    int free_list[PICOQUIC_SOCK_IO_NB_BUFFERS];
+    int nb_free;
+} picoquic_sock_io_ctx_t;
+
+static void picoquic_sock_io_close(void* io_ctx)
+{
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)io_ctx;
+
+    if (sock_io != NULL) {
+        for (int i = 0; i < sock_io->nb_sockets; i++) {
+            picoquic_packet_loop_close_socket(&sock_io->s_ctx[i]);
+        }
+        if (sock_io->buffers != NULL) {
+            free(sock_io->buffers);
+        }
+        free(sock_io);
+    }
+}
+
+static int picoquic_sock_io_open(picoquic_packet_loop_param_t* param, void* provider_param, int wake_up_fd,
+    void** io_ctx, struct sockaddr_storage* local_addr)
+{
+    int ret = 0;
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)malloc(sizeof(picoquic_sock_io_ctx_t));
+
+    *io_ctx = NULL;
+    (void)provider_param;
+
+    if (sock_io == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(sock_io, 0, sizeof(picoquic_sock_io_ctx_t));
+        sock_io->param = param;
+        sock_io->wake_up_fd = wake_up_fd;
+        /* Each buffer can hold a GSO train, unless GSO is disabled */
+        sock_io->buffer_size = (param->do_not_use_gso) ? PICOQUIC_MAX_JUMBO_PACKET_SIZE : 0xFFFF;
+        for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+            sock_io->s_ctx[i].reuse_port = (param->reuse_port) ? 1 : 0;
+            sock_io->s_ctx[i].reuseport_steering_shards = param->reuseport_steering_shards;
+            sock_io->s_ctx[i].use_rx_timestamps = (param->use_receive_timestamps) ? 1 : 0;
+        }
+        if ((sock_io->buffers = (uint8_t*)malloc(sock_io->buffer_size * PICOQUIC_SOCK_IO_NB_BUFFERS)) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if ((sock_io->nb_sockets = picoquic_packet_loop_open_sockets(param->local_port,
+            param->local_af, param->socket_buffer_size,
+            param->extra_socket_required, param->do_not_use_gso, sock_io->s_ctx)) <= 0) {
+            sock_io->nb_sockets = 0;
+            ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+        }
+        else {
+            for (int i = 0; i < PICOQUIC_SOCK_IO_NB_BUFFERS; i++) {
+                sock_io->free_list[i] = i;
+            }
+            sock_io->nb_free = PICOQUIC_SOCK_IO_NB_BUFFERS;
+            (void)picoquic_store_loopback_addr(local_addr, sock_io->s_ctx[0].af, sock_io->s_ctx[0].port);
+        }
+
+        if (ret == 0) {
+            *io_ctx = sock_io;
+        }
+        else {
+            picoquic_sock_io_close(sock_io);
+        }
+    }
+
+    return ret;
+}
+
+static int picoquic_sock_io_get_buffer(void* io_ctx, picoquic_packet_io_t* packet)
+{
+    int ret = 0;
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)io_ctx;
+
+    if (sock_io->nb_free <= 0) {
+        ret = -1;
+    }
+    else {
+        int index = sock_io->free_list[--sock_io->nb_free];
+        packet->bytes = sock_io->buffers + (size_t)index * sock_io->buffer_size;
+        packet->buffer_size = sock_io->buffer_size;
+        packet->length = 0;
+        packet->handle = (uint64_t)index;
+    }
+    return ret;
+}
+
+static void picoquic_sock_io_release_buffer(void* io_ctx, picoquic_packet_io_t* packet)
+{
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)io_ctx;
+
+    if (packet->handle < PICOQUIC_SOCK_IO_NB_BUFFERS && sock_io->nb_free < PICOQUIC_SOCK_IO_NB_BUFFERS) {
+        sock_io->free_list[sock_io->nb_free++] = (int)packet->handle;
+    }
+    packet->bytes = NULL;
+}
+
+static int picoquic_sock_io_rx_burst(void* io_ctx, picoquic_packet_io_t* packets, int nb_max)
+{
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)io_ctx;
+    int nb_received = 0;
+
+    /* Read the sockets in turn, starting after the last one read */
+    for (int k = 0; k < sock_io->nb_sockets && nb_received < nb_max; k++) {
+        int i = (sock_io->next_rank + k) % sock_io->nb_sockets;
+        picoquic_socket_ctx_t* s_ctx = &sock_io->s_ctx[i];
+
+        while (nb_received < nb_max) {
+            picoquic_packet_io_t* packet = &packets[nb_received];
+            int bytes_recv;
+
+            if (picoquic_sock_io_get_buffer(io_ctx, packet) != 0) {
+                break;
+            }
+            packet->send_msg_size = 0;
+            packet->ecn = 0;
+            memset(&packet->addr_local, 0, sizeof(struct sockaddr_storage));
+            bytes_recv = picoquic_recvmsg_ex(s_ctx->fd, &packet->addr_peer, &packet->addr_local,
+                &packet->if_index, &packet->ecn, packet->bytes, (int)packet->buffer_size, MSG_DONTWAIT,
+                NULL, (s_ctx->use_rx_timestamps) ? &packet->receive_time : NULL);
+            if (bytes_recv <= 0) {
+                /* Drained, or error such as ICMP unreachable. Either way, try the next socket. */
+                picoquic_sock_io_release_buffer(io_ctx, packet);
+                break;
+            }
+            packet->length = (size_t)bytes_recv;
+            if (!s_ctx->use_rx_timestamps) {
+                packet->receive_time = 0;
+            }
+            /* Document incoming port */
+            if (packet->addr_local.ss_family == AF_INET6) {
+                ((struct sockaddr_in6*)&packet->addr_local)->sin6_port = s_ctx->n_port;
+            }
+            else if (packet->addr_local.ss_family == AF_INET) {
+                ((struct sockaddr_in*)&packet->addr_local)->sin_port = s_ctx->n_port;
+            }
+            nb_received++;
+        }
+    }
+    if (sock_io->nb_sockets > 0) {
+        sock_io->next_rank = (sock_io->next_rank + 1) % sock_io->nb_sockets;
+    }
+
+    return nb_received;
+}
+
+static int picoquic_sock_io_tx_burst(void* io_ctx, picoquic_packet_io_t* packets, int nb_packets, int* sock_err)
+{
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)io_ctx;
+    int nb_sent = 0;
+
+    *sock_err = 0;
+    while (nb_sent < nb_packets) {
+        picoquic_packet_io_t* packet = &packets[nb_sent];
+        SOCKET_TYPE fd = picoquic_packet_loop_get_send_socket(sock_io->s_ctx, sock_io->nb_sockets,
+            sock_io->param, &packet->addr_peer, &packet->addr_local);
+        int sock_ret;
+
+        if (fd == INVALID_SOCKET) {
+            *sock_err = EAFNOSUPPORT;
+            break;
+        }
+        sock_ret = picoquic_sendmsg(fd, (struct sockaddr*)&packet->addr_peer, (struct sockaddr*)&packet->addr_local,
+            packet->if_index, (const char*)packet->bytes, (int)packet->length, (int)packet->send_msg_size, sock_err);
+        if (sock_ret <= 0) {
+            break;
+        }
+        picoquic_sock_io_release_buffer(io_ctx, packet);
+        nb_sent++;
+    }
+
+    return nb_sent;
+}
+
+static int picoquic_sock_io_wait(void* io_ctx, int64_t delta_t, int* is_wake_up)
+{
+    picoquic_sock_io_ctx_t* sock_io = (picoquic_sock_io_ctx_t*)io_ctx;
+    fd_set readfds;
+    struct timeval tv;
+    int ret_select = 0;
+    int ret = 0;
+    int sockmax = 0;
+
+    *is_wake_up = 0;
+    FD_ZERO(&readfds);
+    for (int i = 0; i < sock_io->nb_sockets; i++) {
+        if (sockmax < (int)sock_io->s_ctx[i].fd) {
+            sockmax = (int)sock_io->s_ctx[i].fd;
+        }
+        FD_SET(sock_io->s_ctx[i].fd, &readfds);
+    }
+    if (sock_io->wake_up_fd >= 0) {
+        if (sockmax < sock_io->wake_up_fd) {
+            sockmax = sock_io->wake_up_fd;
+        }
+        FD_SET(sock_io->wake_up_fd, &readfds);
+    }
+
+    if (delta_t <= 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+    }
+    else if (delta_t > 10000000) {
+        tv.tv_sec = (long)10;
+        tv.tv_usec = 0;
+    }
+    else {
+        tv.tv_sec = (long)(delta_t / 1000000);
+        tv.tv_usec = (long)(delta_t % 1000000);
+    }
+
+    ret_select = select(sockmax + 1, &readfds, NULL, NULL, &tv);
+
+    if (ret_select < 0) {
+        if (errno != EINTR) {
+            ret = -1;
+            DBG_PRINTF("Error: select returns %d, err=%d\n", ret_select, errno);
+        }
+    }
+    else if (ret_select > 0) {
+        if (sock_io->wake_up_fd >= 0 && FD_ISSET(sock_io->wake_up_fd, &readfds)) {
+            *is_wake_up = 1;
+            ret_select--;
+        }
+        ret = (ret_select > 0) ? 1 : 0;
+    }
+
+    return ret;
+}
+
+const picoquic_packet_io_provider_t picoquic_socket_io_provider = {
+    "sockets",
+    picoquic_sock_io_open,
+    picoquic_sock_io_close,
+    picoquic_sock_io_rx_burst,
+    picoquic_sock_io_tx_burst,
+    picoquic_sock_io_get_buffer,
+    picoquic_sock_io_release_buffer,
+    picoquic_sock_io_wait,
+    NULL,
+    1
+};
+
+/* Send the packets prepared in this iteration. If a packet cannot be sent,
+ * report the error for that packet, release its buffer, and continue with
+ * the next one. */
+static void picoquic_packet_loop_provider_flush(picoquic_quic_t* quic,
+    const picoquic_packet_io_provider_t* io_provider, void* io_ctx,
+    picoquic_packet_io_t* packets, picoquic_cnx_t** cnx, picoquic_connection_id_t* log_cid,
+    int nb_packets, size_t** send_msg_ptr, uint64_t current_time)
+{
+    int nb_done = 0;
+
+    while (nb_done < nb_packets) {
+        int sock_err = 0;
+        int nb_sent = io_provider->tx_burst(io_ctx, packets + nb_done, nb_packets - nb_done, &sock_err);
+
+        if (nb_sent < 0) {
+            nb_sent = 0;
+        }
+        nb_done += nb_sent;
+        if (nb_done < nb_packets) {
+            picoquic_packet_io_t* packet = &packets[nb_done];
+            picoquic_cnx_t* last_cnx = picoquic_packet_loop_check_cnx(quic, cnx[nb_done], &log_cid[nb_done]);
+
+            picoquic_packet_loop_send_error(quic, last_cnx, &log_cid[nb_done], INVALID_SOCKET,
+                &packet->addr_peer, &packet->addr_local, packet->if_index, packet->bytes, packet->length,
+                packet->send_msg_size, -1, sock_err, send_msg_ptr, current_time);
+            io_provider->release_buffer(io_ctx, packet);
+            nb_done++;
+        }
+    }
+}
+
+void* picoquic_packet_loop_provider(void* v_ctx)
+{
+    picoquic_network_thread_ctx_t* thread_ctx = (picoquic_network_thread_ctx_t*)v_ctx;
+    picoquic_quic_t* quic = thread_ctx->quic;
+    picoquic_packet_loop_param_t* param = thread_ctx->param;
+    picoquic_packet_loop_cb_fn loop_callback = thread_ctx->loop_callback;
+    void* loop_callback_ctx = thread_ctx->loop_callback_ctx;
+    const picoquic_packet_io_provider_t* io_provider = param->io_provider;
+    void* io_ctx = NULL;
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    uint64_t stack_time = 0;
+    int64_t delay_max = 10000000;
+    size_t send_msg_size = 0;
+    size_t* send_msg_ptr = NULL;
+    int wake_up_fd = -1;
+    struct sockaddr_storage l_addr;
+    picoquic_packet_io_t rx_packets[PICOQUIC_PACKET_LOOP_BATCH_MAX];
+    picoquic_packet_io_t tx_packets[PICOQUIC_PACKET_LOOP_BATCH_MAX];
+    picoquic_cnx_t* tx_cnx[PICOQUIC_PACKET_LOOP_BATCH_MAX];
+    picoquic_connection_id_t tx_log_cid[PICOQUIC_PACKET_LOOP_BATCH_MAX];
+    size_t recv_max = picoquic_get_packet_loop_recv_max(quic);
+    size_t send_max = picoquic_get_packet_loop_send_max(quic);
+    picoquic_cnx_t* last_cnx = NULL;
+    picoquic_packet_loop_options_t options = { 0 };
+    packet_loop_system_call_duration_t sc_duration = { 0 };
+
+    if (thread_ctx->thread_name != NULL) {
+        thread_ctx->thread_setname_fn(thread_ctx->thread_name);
+    }
+    picoquic_packet_loop_set_affinity(param);
+
+    if (io_provider->supports_segmentation && !param->do_not_use_gso) {
+        send_msg_ptr = &send_msg_size;
+    }
+    if (thread_ctx->wake_up_defined && io_provider->wake == NULL) {
+        wake_up_fd = thread_ctx->wake_up_pipe_fd[0];
+    }
+    memset(&l_addr, 0, sizeof(l_addr));
+
+    if ((ret = io_provider->open(param, param->io_provider_param, wake_up_fd, &io_ctx, &l_addr)) != 0) {
+        DBG_PRINTF("Cannot open the packet I/O provider %s, ret = %d", io_provider->name, ret);
+        io_ctx = NULL;
+    }
+    else {
+        thread_ctx->io_ctx = io_ctx;
+        if (loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+            if (ret == 0 && l_addr.ss_family != 0) {
+                ret = loop_callback(quic, picoquic_packet_loop_port_update, loop_callback_ctx, &l_addr);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        thread_ctx->thread_is_ready = 1;
+    }
+    else {
+        DBG_PRINTF("%s", "Thread cannot run");
+    }
+
+    while (ret == 0 && !thread_ctx->thread_should_close) {
+        int64_t delta_t;
+        uint64_t previous_time;
+        size_t bytes_recv = 0;
+        size_t bytes_sent = 0;
+        int is_wake_up_event = 0;
+        int nb_received = 0;
+        int nb_prepared = 0;
+
+        current_time = picoquic_current_time();
+        delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
+        if (options.do_time_check) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = loop_callback(quic, picoquic_packet_loop_time_check, loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+        previous_time = current_time;
+        if (io_provider->wait(io_ctx, delta_t, &is_wake_up_event) < 0) {
+            ret = (thread_ctx->thread_should_close) ? PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP : -1;
+            break;
+        }
+        current_time = picoquic_refresh_quic_time(quic);
+        if (delta_t > 0) {
+            /* The loop was blocked in the wait, and woke up */
+            picoquic_record_loop_wakeup(quic, current_time);
+        }
+        if (options.do_system_call_duration && delta_t == 0 &&
+            picoquic_packet_loop_monitor_system_call_duration(&sc_duration, current_time, previous_time)) {
+            ret = loop_callback(quic, picoquic_packet_loop_system_call_duration,
+                loop_callback_ctx, &sc_duration);
+        }
+
+        if (is_wake_up_event && wake_up_fd >= 0) {
+            /* Something was written on the "wakeup" pipe. Read it. */
+            uint8_t eventbuf[8];
+            int pipe_recv;
+            if ((pipe_recv = (int)read(wake_up_fd, eventbuf, sizeof(eventbuf))) <= 0) {
+                ret = (thread_ctx->thread_should_close) ? PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP : -1;
+                DBG_PRINTF("Error: read pipe returns %d\n", (pipe_recv == 0) ? EPIPE : errno);
+            }
+        }
+        else if (io_provider->wake != NULL &&
+            __atomic_exchange_n(&thread_ctx->io_wake_up_requested, 0, __ATOMIC_ACQ_REL) != 0) {
+            is_wake_up_event = 1;
+        }
+
+        /* Process a burst of incoming packets */
+        if (ret == 0) {
+            nb_received = io_provider->rx_burst(io_ctx, rx_packets, (int)recv_max);
+            if (nb_received < 0) {
+                ret = -1;
+            }
+            else if (nb_received > 0) {
+                picoquic_receive_batch_start(quic);
+                for (int i = 0; i < nb_received; i++) {
+                    picoquic_packet_io_t* packet = &rx_packets[i];
+
+                    if (packet->receive_time != 0 && param->use_receive_timestamps) {
+                        uint64_t receive_time = (packet->receive_time < stack_time) ? stack_time : packet->receive_time;
+                        (void)picoquic_incoming_packet_ts(quic, packet->bytes, packet->length,
+                            (struct sockaddr*)&packet->addr_peer, (struct sockaddr*)&packet->addr_local,
+                            packet->if_index, packet->ecn, &last_cnx, receive_time, current_time);
+                    }
+                    else {
+                        (void)picoquic_incoming_packet_ex(quic, packet->bytes, packet->length,
+                            (struct sockaddr*)&packet->addr_peer, (struct sockaddr*)&packet->addr_local,
+                            packet->if_index, packet->ecn, &last_cnx, current_time);
+                    }
+                    bytes_recv += packet->length;
+                    io_provider->release_buffer(io_ctx, packet);
+                }
+                picoquic_receive_batch_end(quic);
+                stack_time = current_time;
+            }
+        }
+
+        if (ret == 0 && is_wake_up_event && !thread_ctx->thread_should_close) {
+            picoquic_run_network_commands(thread_ctx);
+            ret = loop_callback(quic, picoquic_packet_loop_wake_up, loop_callback_ctx, NULL);
+        }
+        if (ret == 0 && bytes_recv > 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_receive, loop_callback_ctx, &bytes_recv);
+        }
+        if (ret == PICOQUIC_NO_ERROR_SIMULATE_NAT) {
+            /* NAT simulation requires several local sockets, which the providers do not expose */
+            ret = 0;
+        }
+
+        /* Prepare a burst of packets in the provider's buffers */
+        while (ret == 0 && (size_t)nb_prepared < send_max) {
+            picoquic_packet_io_t* packet = &tx_packets[nb_prepared];
+
+            if (io_provider->get_buffer(io_ctx, packet) != 0) {
+                break;
+            }
+            packet->if_index = param->dest_if;
+            packet->send_msg_size = 0;
+            packet->ecn = 0;
+            packet->receive_time = 0;
+            memset(&packet->addr_local, 0, sizeof(struct sockaddr_storage));
+
+            ret = picoquic_prepare_next_packet_ex(quic, current_time,
+                packet->bytes, packet->buffer_size, &packet->length,
+                &packet->addr_peer, &packet->addr_local, &packet->if_index,
+                &tx_log_cid[nb_prepared], &tx_cnx[nb_prepared],
+                (send_msg_ptr == NULL) ? NULL : &packet->send_msg_size);
+
+            if (ret != 0 || packet->length == 0) {
+                io_provider->release_buffer(io_ctx, packet);
+                break;
+            }
+            if (packet->length > param->send_length_max) {
+                param->send_length_max = packet->length;
+            }
+            bytes_sent += packet->length;
+            nb_prepared++;
+        }
+        if (nb_prepared > 0) {
+            picoquic_packet_loop_provider_flush(quic, io_provider, io_ctx, tx_packets, tx_cnx, tx_log_cid,
+                nb_prepared, &send_msg_ptr, current_time);
+        }
+
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    thread_ctx->thread_is_ready = 0;
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        /* Normal termination requested by the application, returns no error */
+        ret = 0;
+    }
+
+    if (io_ctx != NULL) {
+        thread_ctx->io_ctx = NULL;
+        io_provider->close(io_ctx);
+    }
+
+    thread_ctx->return_code = ret;
+    thread_ctx->thread_is_closed = 1;
+    if (thread_ctx->is_threaded) {
+        pthread_exit((void*)&thread_ctx->return_code);
+    }
+    return(NULL);
+}
+#endif
@@ -0,0 +1,794 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Variant of the socket loop using Windows Registered I/O (RIO).
+ *
+ * All the buffers used by the loop are carved from a single memory region,
+ * registered once with RIORegisterBuffer. Each socket keeps a set of
+ * RIOReceiveEx requests posted, each pointing to its own data, remote address
+ * and control slices of the region. Outgoing packets are prepared in a pool
+ * of send slots, and are posted with RIOSendEx and the flag RIO_MSG_DEFER.
+ * The deferred sends are committed with a single call per socket after
+ * all the packets available in the loop iteration have been prepared.
+ *
+ * Send and receive completions are posted to a single completion queue,
+ * and retrieved in batches with RIODequeueCompletion. When the queue is
+ * empty, the loop arms the notification with RIONotify and waits for either
+ * the completion event or the wake up event of the network thread.
+ *
+ * If the system supports UDP receive offload (URO), the receive slots are
+ * sized for PICOQUIC_RIO_RECV_COALESCED_SIZE bytes and the sockets are set
+ * to receive coalesced datagrams, which are split into segments before
+ * being submitted to the stack. If it supports UDP send offload (USO), the
+ * packets are prepared as trains of segments of the same size and sent
+ * with UDP_SEND_MSG_SIZE. If the RIO extension cannot be loaded, the loop
+ * falls back to picoquic_packet_loop_v3.
+ */
+
+#ifdef _WINDOWS
+#include "picosocks.h"
+#include "picoquic.h"
+#include "picoquic_internal.h"
+#include "picoquic_packet_loop.h"
+#include "picoquic_unified_log.h"
+
+#define PICOQUIC_RIO_RECV_SLOTS 64
+#define PICOQUIC_RIO_RECV_COALESCED_SIZE 0x8000
+#define PICOQUIC_RIO_CMSG_SIZE 256
+#define PICOQUIC_RIO_DEQUEUE_MAX 128
+#define PICOQUIC_RIO_DRAIN_TIMEOUT 100000
+
+#ifndef RIO_CMSG_BASE_SIZE
+#define RIO_CMSG_BASE_SIZE WSA_CMSGHDR_ALIGN(sizeof(RIO_CMSG_BUFFER))
+#endif
+
+/* The request context of each operation documents the type of request
+ * and the receive or send slot to which it applies. The context is passed
+ * as a pointer, so the tags must fit in 32 bits. */
+#define PICOQUIC_RIO_TAG_RECV 0x40000000u
+#define PICOQUIC_RIO_TAG_SEND 0x80000000u
+#define PICOQUIC_RIO_TAG_MASK 0xC0000000u
+
+/* The control slices are placed first, so they are aligned as required
+ * by RIO_CMSG_BUFFER and WSACMSGHDR. The receive data slices are kept
+ * in a separate part of the region, because their size depends on
+ * whether coalesced receive is available. */
+typedef struct st_picoquic_rio_recv_buffer_t {
+    uint64_t control[PICOQUIC_RIO_CMSG_SIZE / sizeof(uint64_t)];
+    SOCKADDR_INET addr_remote;
+} picoquic_rio_recv_buffer_t;
+
+typedef struct st_picoquic_rio_send_header_t {
+    uint64_t control[PICOQUIC_RIO_CMSG_SIZE / sizeof(uint64_t)];
+    SOCKADDR_INET addr_remote;
+} picoquic_rio_send_header_t;
+
+typedef struct st_picoquic_rio_send_slot_t {
+    struct sockaddr_storage addr_peer;
+    struct sockaddr_storage addr_local;
+    int if_index;
+    size_t length;
+    size_t send_msg_size;
+    SOCKET_TYPE fd;
+    int socket_rank;
+    picoquic_cnx_t* cnx;
+    picoquic_connection_id_t log_cid;
+    picoquic_rio_send_header_t* header;
+    uint8_t* buffer;
+} picoquic_rio_send_slot_t;
+
+typedef struct st_picoquic_rio_loop_t {
+    RIO_EXTENSION_FUNCTION_TABLE rio;
+    RIO_CQ cq;
+    HANDLE cq_event;
+    int notify_armed;
+    RIO_RQ rq[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    int nb_sockets;
+    int nb_recv_pending;
+    int commit_needed[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    uint8_t* region;
+    size_t region_size;
+    RIO_BUFFERID buffer_id;
+    picoquic_rio_recv_buffer_t* recv_buffers;
+    uint8_t* recv_data;
+    size_t recv_data_size;
+    picoquic_rio_send_header_t* send_headers;
+    uint8_t* send_buffers;
+    size_t send_buffer_size;
+    picoquic_rio_send_slot_t* send_slots;
+    int* free_slots;
+    int nb_send_slots;
+    int nb_free_slots;
+    RIORESULT results[PICOQUIC_RIO_DEQUEUE_MAX];
+} picoquic_rio_loop_t;
+
+/* Load the RIO function table. The table is the same for all the
+ * UDP sockets, so it is obtained once from a temporary socket. */
+static int picoquic_rio_load_table(RIO_EXTENSION_FUNCTION_TABLE* rio)
+{
+    int ret = 0;
+    GUID rio_guid = WSAID_MULTIPLE_RIO;
+    DWORD nb_bytes = 0;
+    SOCKET fd = WSASocket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+
+    if (fd == INVALID_SOCKET) {
+        DBG_PRINTF("Cannot create a registered I/O socket, err=%d", WSAGetLastError());
+        ret = -1;
+    }
+    else {
+        memset(rio, 0, sizeof(RIO_EXTENSION_FUNCTION_TABLE));
+        rio->cbSize = sizeof(RIO_EXTENSION_FUNCTION_TABLE);
+        if (WSAIoctl(fd, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &rio_guid, sizeof(rio_guid),
+            rio, sizeof(RIO_EXTENSION_FUNCTION_TABLE), &nb_bytes, NULL, NULL) == SOCKET_ERROR) {
+            DBG_PRINTF("Cannot load the RIO function table, err=%d", WSAGetLastError());
+            ret = -1;
+        }
+        closesocket(fd);
+    }
+    return ret;
+}
+
+static RIO_BUF picoquic_rio_buf(picoquic_rio_loop_t* r_loop, void* ptr, size_t length)
+{
+    RIO_BUF buf;
+
+    buf.BufferId = r_loop->buffer_id;
+    buf.Offset = (ULONG)((uint8_t*)ptr - r_loop->region);
+    buf.Length = (ULONG)length;
+
+    return buf;
+}
+
+static void picoquic_rio_loop_release(picoquic_rio_loop_t* r_loop)
+{
+    if (r_loop->cq != RIO_INVALID_CQ) {
+        r_loop->rio.RIOCloseCompletionQueue(r_loop->cq);
+        r_loop->cq = RIO_INVALID_CQ;
+    }
+    if (r_loop->cq_event != NULL) {
+        CloseHandle(r_loop->cq_event);
+        r_loop->cq_event = NULL;
+    }
+    if (r_loop->buffer_id != RIO_INVALID_BUFFERID) {
+        r_loop->rio.RIODeregisterBuffer(r_loop->buffer_id);
+        r_loop->buffer_id = RIO_INVALID_BUFFERID;
+    }
+    if (r_loop->region != NULL) {
+        VirtualFree(r_loop->region, 0, MEM_RELEASE);
+        r_loop->region = NULL;
+    }
+    if (r_loop->send_slots != NULL) {
+        free(r_loop->send_slots);
+    }
+    if (r_loop->free_slots != NULL) {
+        free(r_loop->free_slots);
+    }
+    free(r_loop);
+}
+
+static picoquic_rio_loop_t* picoquic_rio_loop_create(int nb_send_slots, size_t send_buffer_size, size_t recv_data_size)
+{
+    picoquic_rio_loop_t* r_loop = (picoquic_rio_loop_t*)malloc(sizeof(picoquic_rio_loop_t));
+
+    if (r_loop != NULL) {
+        int ret = 0;
+        size_t nb_recv_slots = PICOQUIC_PACKET_LOOP_SOCKETS_MAX * PICOQUIC_RIO_RECV_SLOTS;
+        size_t recv_size = nb_recv_slots * (sizeof(picoquic_rio_recv_buffer_t) + recv_data_size);
+        size_t header_size = nb_send_slots * sizeof(picoquic_rio_send_header_t);
+
+        memset(r_loop, 0, sizeof(picoquic_rio_loop_t));
+        r_loop->cq = RIO_INVALID_CQ;
+        r_loop->buffer_id = RIO_INVALID_BUFFERID;
+        for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+            r_loop->rq[i] = RIO_INVALID_RQ;
+        }
+        r_loop->nb_send_slots = nb_send_slots;
+        r_loop->send_buffer_size = send_buffer_size;
+        r_loop->recv_data_size = recv_data_size;
+        r_loop->region_size = recv_size + header_size + nb_send_slots * send_buffer_size;
+
+        if (picoquic_rio_load_table(&r_loop->rio) != 0) {
+            ret = -1;
+        }
+        else if ((r_loop->region = (uint8_t*)VirtualAlloc(NULL, r_loop->region_size,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL) {
+            DBG_PRINTF("Cannot allocate %zu bytes for RIO buffers, err=%d", r_loop->region_size, GetLastError());
+            ret = -1;
+        }
+        else if ((r_loop->buffer_id = r_loop->rio.RIORegisterBuffer((PCHAR)r_loop->region,
+            (DWORD)r_loop->region_size)) == RIO_INVALID_BUFFERID) {
+            DBG_PRINTF("RIORegisterBuffer fails, err=%d", WSAGetLastError());
+            ret = -1;
+        }
+        else if ((r_loop->cq_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL) {
+            ret = -1;
+        }
+        else {
+            r_loop->recv_buffers = (picoquic_rio_recv_buffer_t*)r_loop->region;
+            r_loop->recv_data = r_loop->region + nb_recv_slots * sizeof(picoquic_rio_recv_buffer_t);
+            r_loop->send_headers = (picoquic_rio_send_header_t*)(r_loop->region + recv_size);
+            r_loop->send_buffers = r_loop->region + recv_size + header_size;
+            r_loop->send_slots = (picoquic_rio_send_slot_t*)malloc(nb_send_slots * sizeof(picoquic_rio_send_slot_t));
+            r_loop->free_slots = (int*)malloc(nb_send_slots * sizeof(int));
+            if (r_loop->send_slots == NULL || r_loop->free_slots == NULL) {
+                ret = -1;
+            }
+            else {
+                memset(r_loop->send_slots, 0, nb_send_slots * sizeof(picoquic_rio_send_slot_t));
+                for (int i = 0; i < nb_send_slots; i++) {
+                    r_loop->send_slots[i].header = &r_loop->send_headers[i];
+                    r_loop->send_slots[i].buffer = r_loop->send_buffers + i * send_buffer_size;
+                    r_loop->free_slots[i] = i;
+                }
+                r_loop->nb_free_slots = nb_send_slots;
+            }
+        }
+        if (ret != 0) {
+            picoquic_rio_loop_release(r_loop);
+            r_loop = NULL;
+        }
+    }
+    return r_loop;
+}
+
+/* Create the completion queue and one request queue per socket, once the
+ * number of sockets is known. The completion queue is sized so that it
+ * cannot overflow, even if all the posted requests complete at once. */
+static int picoquic_rio_open_queues(picoquic_rio_loop_t* r_loop, picoquic_socket_ctx_t* s_ctx, int nb_sockets)
+{
+    int ret = 0;
+    RIO_NOTIFICATION_COMPLETION completion;
+
+    memset(&completion, 0, sizeof(completion));
+    completion.Type = RIO_EVENT_COMPLETION;
+    completion.Event.EventHandle = r_loop->cq_event;
+    completion.Event.NotifyReset = TRUE;
+
+    r_loop->nb_sockets = nb_sockets;
+    if ((r_loop->cq = r_loop->rio.RIOCreateCompletionQueue(
+        (DWORD)(nb_sockets * (PICOQUIC_RIO_RECV_SLOTS + r_loop->nb_send_slots)), &completion)) == RIO_INVALID_CQ) {
+        DBG_PRINTF("RIOCreateCompletionQueue fails, err=%d", WSAGetLastError());
+        ret = -1;
+    }
+    for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+        if ((r_loop->rq[i] = r_loop->rio.RIOCreateRequestQueue(s_ctx[i].fd,
+            PICOQUIC_RIO_RECV_SLOTS, 1, (ULONG)r_loop->nb_send_slots, 1,
+            r_loop->cq, r_loop->cq, (PVOID)(intptr_t)i)) == RIO_INVALID_RQ) {
+            DBG_PRINTF("RIOCreateRequestQueue fails on socket %d, err=%d", i, WSAGetLastError());
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* Post the receive request for a slot. All but the last receives posted
+ * in a batch are deferred, and committed together with the last one. */
+static int picoquic_rio_post_recv(picoquic_rio_loop_t* r_loop, int socket_rank, int slot_rank, int is_deferred)
+{
+    int ret = 0;
+    int slot_index = socket_rank * PICOQUIC_RIO_RECV_SLOTS + slot_rank;
+    picoquic_rio_recv_buffer_t* recv_buffer = &r_loop->recv_buffers[slot_index];
+    RIO_BUF data = picoquic_rio_buf(r_loop, r_loop->recv_data + slot_index * r_loop->recv_data_size,
+        r_loop->recv_data_size);
+    RIO_BUF remote = picoquic_rio_buf(r_loop, &recv_buffer->addr_remote, sizeof(recv_buffer->addr_remote));
+    RIO_BUF control = picoquic_rio_buf(r_loop, recv_buffer->control, sizeof(recv_buffer->control));
+
+    if (!r_loop->rio.RIOReceiveEx(r_loop->rq[socket_rank], &data, 1, NULL, &remote, &control, NULL,
+        (is_deferred) ? RIO_MSG_DEFER : 0, (PVOID)(uintptr_t)(PICOQUIC_RIO_TAG_RECV | (uint32_t)slot_index))) {
+        DBG_PRINTF("RIOReceiveEx fails on socket %d, err=%d", socket_rank, WSAGetLastError());
+        ret = -1;
+    }
+    else {
+        r_loop->nb_recv_pending++;
+    }
+    return ret;
+}
+
+/* Post a deferred send for the packet prepared in the slot. The send is
+ * only handed to the network when the socket queue is committed. */
+static int picoquic_rio_post_send(picoquic_rio_loop_t* r_loop, int slot_index)
+{
+    int ret = 0;
+    picoquic_rio_send_slot_t* slot = &r_loop->send_slots[slot_index];
+    RIO_CMSG_BUFFER* rio_cmsg = (RIO_CMSG_BUFFER*)slot->header->control;
+    WSAMSG msg;
+    RIO_BUF data = picoquic_rio_buf(r_loop, slot->buffer, slot->length);
+    RIO_BUF remote = picoquic_rio_buf(r_loop, &slot->header->addr_remote, sizeof(slot->header->addr_remote));
+    RIO_BUF control;
+
+    memset(&slot->header->addr_remote, 0, sizeof(slot->header->addr_remote));
+    memcpy(&slot->header->addr_remote, &slot->addr_peer, picoquic_addr_length((struct sockaddr*)&slot->addr_peer));
+
+    memset(&msg, 0, sizeof(msg));
+    msg.Control.buf = (char*)slot->header->control + RIO_CMSG_BASE_SIZE;
+    msg.Control.len = (ULONG)(sizeof(slot->header->control) - RIO_CMSG_BASE_SIZE);
+    picoquic_socks_cmsg_format(&msg, slot->length, slot->send_msg_size,
+        (struct sockaddr*)&slot->addr_local, slot->if_index);
+    rio_cmsg->TotalLength = (ULONG)(RIO_CMSG_BASE_SIZE + msg.Control.len);
+    control = picoquic_rio_buf(r_loop, slot->header->control, rio_cmsg->TotalLength);
+
+    if (!r_loop->rio.RIOSendEx(r_loop->rq[slot->socket_rank], &data, 1, NULL, &remote,
+        (msg.Control.len > 0) ? &control : NULL, NULL, RIO_MSG_DEFER,
+        (PVOID)(uintptr_t)(PICOQUIC_RIO_TAG_SEND | (uint32_t)slot_index))) {
+        ret = WSAGetLastError();
+    }
+    else {
+        r_loop->commit_needed[slot->socket_rank] = 1;
+    }
+    return ret;
+}
+
+/* Commit the deferred sends posted on each socket since the last call */
+static int picoquic_rio_commit_sends(picoquic_rio_loop_t* r_loop)
+{
+    int ret = 0;
+
+    for (int i = 0; i < r_loop->nb_sockets; i++) {
+        if (r_loop->commit_needed[i]) {
+            r_loop->commit_needed[i] = 0;
+            if (!r_loop->rio.RIOSendEx(r_loop->rq[i], NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL)) {
+                DBG_PRINTF("Cannot commit the sends on socket %d, err=%d", i, WSAGetLastError());
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+/* Process one receive completion, then post the receive again.
+ * Returns the number of bytes received, or -1 if the receive cannot be posted. */
+static int picoquic_rio_process_recv(picoquic_quic_t* quic, picoquic_rio_loop_t* r_loop,
+    picoquic_socket_ctx_t* s_ctx, int nb_sockets_available, RIORESULT* result,
+    picoquic_cnx_t** last_cnx, uint64_t current_time)
+{
+    int bytes_recv = 0;
+    int slot_index = (int)(result->RequestContext & ~PICOQUIC_RIO_TAG_MASK);
+    int socket_rank = slot_index / PICOQUIC_RIO_RECV_SLOTS;
+    picoquic_rio_recv_buffer_t* recv_buffer = &r_loop->recv_buffers[slot_index];
+    uint8_t* recv_data = r_loop->recv_data + slot_index * r_loop->recv_data_size;
+
+    r_loop->nb_recv_pending--;
+    if (result->Status == 0 && result->BytesTransferred > 0 && socket_rank < nb_sockets_available) {
+        RIO_CMSG_BUFFER* rio_cmsg = (RIO_CMSG_BUFFER*)recv_buffer->control;
+        struct sockaddr_storage addr_from;
+        struct sockaddr_storage addr_to;
+        WSAMSG msg;
+        int if_index_to = 0;
+        unsigned char received_ecn = 0;
+        size_t udp_coalesced_size = 0;
+        size_t recv_bytes = 0;
+
+        memset(&addr_from, 0, sizeof(addr_from));
+        memcpy(&addr_from, &recv_buffer->addr_remote, sizeof(recv_buffer->addr_remote));
+        memset(&addr_to, 0, sizeof(addr_to));
+        memset(&msg, 0, sizeof(msg));
+        if (rio_cmsg->TotalLength > RIO_CMSG_BASE_SIZE &&
+            rio_cmsg->TotalLength <= sizeof(recv_buffer->control)) {
+            msg.Control.buf = (char*)recv_buffer->control + RIO_CMSG_BASE_SIZE;
+            msg.Control.len = (ULONG)(rio_cmsg->TotalLength - RIO_CMSG_BASE_SIZE);
+            picoquic_socks_cmsg_parse(&msg, &addr_to, &if_index_to, &received_ecn, &udp_coalesced_size);
+        }
+        /* Document incoming port */
+        if (addr_to.ss_family == AF_INET6) {
+            ((struct sockaddr_in6*)&addr_to)->sin6_port = s_ctx[socket_rank].n_port;
+        }
+        else if (addr_to.ss_family == AF_INET) {
+            ((struct sockaddr_in*)&addr_to)->sin_port = s_ctx[socket_rank].n_port;
+        }
+        /* Split the coalesced datagrams, and submit each one to the stack */
+        if (udp_coalesced_size > 0) {
+            picoquic_prepare_header_masks(quic, recv_data, result->BytesTransferred, udp_coalesced_size);
+        }
+        while (recv_bytes < result->BytesTransferred) {
+            size_t recv_length = result->BytesTransferred - recv_bytes;
+
+            if (udp_coalesced_size > 0 && recv_length > udp_coalesced_size) {
+                recv_length = udp_coalesced_size;
+            }
+            (void)picoquic_incoming_packet_ex(quic, recv_data + recv_bytes, recv_length,
+                (struct sockaddr*)&addr_from, (struct sockaddr*)&addr_to, if_index_to, received_ecn,
+                last_cnx, current_time);
+            recv_bytes += recv_length;
+        }
+        bytes_recv = (int)result->BytesTransferred;
+    }
+    else if (result->Status != 0 && result->Status != WSAEMSGSIZE && result->Status != WSAECONNRESET) {
+        DBG_PRINTF("RIO receive on socket %d fails, err=%d", socket_rank, result->Status);
+    }
+
+    if (picoquic_rio_post_recv(r_loop, socket_rank, slot_index % PICOQUIC_RIO_RECV_SLOTS, 1) != 0) {
+        bytes_recv = -1;
+    }
+    return bytes_recv;
+}
+
+static void picoquic_rio_process_send(picoquic_quic_t* quic, picoquic_rio_loop_t* r_loop,
+    RIORESULT* result, size_t** send_msg_ptr, uint64_t current_time)
+{
+    int slot_index = (int)(result->RequestContext & ~PICOQUIC_RIO_TAG_MASK);
+    picoquic_rio_send_slot_t* slot = &r_loop->send_slots[slot_index];
+
+    if (result->Status != 0) {
+        picoquic_cnx_t* cnx = picoquic_packet_loop_check_cnx(quic, slot->cnx, &slot->log_cid);
+        picoquic_packet_loop_send_error(quic, cnx, &slot->log_cid, slot->fd,
+            &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+            slot->send_msg_size, -1, result->Status, send_msg_ptr, current_time);
+    }
+    r_loop->free_slots[r_loop->nb_free_slots++] = slot_index;
+}
+
+/* Retrieve the completions. If none is available, arm the notification and
+ * wait until the completion event or the wake up event fires, or the delay
+ * expires. Returns the number of completions, or -1 on error. */
+static int picoquic_rio_wait(picoquic_rio_loop_t* r_loop, picoquic_network_thread_ctx_t* thread_ctx,
+    int64_t delta_t, int* is_wake_up_event)
+{
+    ULONG nb_results = r_loop->rio.RIODequeueCompletion(r_loop->cq, r_loop->results, PICOQUIC_RIO_DEQUEUE_MAX);
+
+    *is_wake_up_event = 0;
+    if (nb_results == RIO_CORRUPT_CQ) {
+        DBG_PRINTF("%s", "RIODequeueCompletion reports a corrupt queue");
+        return -1;
+    }
+    if (nb_results == 0 && delta_t > 0) {
+        HANDLE events[2];
+        DWORD nb_events = 0;
+        DWORD ret_event;
+        DWORD dwDeltaT = (DWORD)(delta_t / 1000);
+
+        if (!r_loop->notify_armed) {
+            int notify_ret = r_loop->rio.RIONotify(r_loop->cq);
+            if (notify_ret != 0 && notify_ret != WSAEALREADY) {
+                DBG_PRINTF("RIONotify fails, err=%d", notify_ret);
+                return -1;
+            }
+            r_loop->notify_armed = 1;
+        }
+        events[nb_events++] = r_loop->cq_event;
+        if (thread_ctx->wake_up_defined) {
+            events[nb_events++] = thread_ctx->wake_up_event;
+        }
+        ret_event = WaitForMultipleObjects(nb_events, events, FALSE, dwDeltaT);
+        if (ret_event == WAIT_FAILED) {
+            DBG_PRINTF("WaitForMultipleObjects fails, error 0x%x", GetLastError());
+            return -1;
+        }
+        else if (ret_event == WAIT_OBJECT_0) {
+            r_loop->notify_armed = 0;
+        }
+        else if (ret_event == WAIT_OBJECT_0 + 1) {
+            *is_wake_up_event = 1;
+            if (ResetEvent(thread_ctx->wake_up_event) == 0) {
+                DBG_PRINTF("Cannot reset network event, error 0x%x", GetLastError());
+                return -1;
+            }
+        }
+        nb_results = r_loop->rio.RIODequeueCompletion(r_loop->cq, r_loop->results, PICOQUIC_RIO_DEQUEUE_MAX);
+        if (nb_results == RIO_CORRUPT_CQ) {
+            DBG_PRINTF("%s", "RIODequeueCompletion reports a corrupt queue");
+            return -1;
+        }
+    }
+    else if (thread_ctx->wake_up_defined && WaitForSingleObject(thread_ctx->wake_up_event, 0) == WAIT_OBJECT_0) {
+        /* The loop is busy, but the wake up requests must still be served */
+        *is_wake_up_event = 1;
+        if (ResetEvent(thread_ctx->wake_up_event) == 0) {
+            DBG_PRINTF("Cannot reset network event, error 0x%x", GetLastError());
+            return -1;
+        }
+    }
+    return (int)nb_results;
+}
+
+/* After the sockets are closed, the pending requests complete with an error.
+ * Wait until all of them have completed, so the region can be safely deregistered. */
+static void picoquic_rio_drain(picoquic_rio_loop_t* r_loop)
+{
+    uint64_t start_time = picoquic_current_time();
+
+    while (r_loop->cq != RIO_INVALID_CQ &&
+        (r_loop->nb_recv_pending > 0 || r_loop->nb_free_slots < r_loop->nb_send_slots) &&
+        picoquic_current_time() - start_time < PICOQUIC_RIO_DRAIN_TIMEOUT) {
+        ULONG nb_results = r_loop->rio.RIODequeueCompletion(r_loop->cq, r_loop->results, PICOQUIC_RIO_DEQUEUE_MAX);
+
+        if (nb_results == RIO_CORRUPT_CQ) {
+            break;
+        }
+        else if (nb_results == 0) {
+            Sleep(1);
+        }
+        for (ULONG i = 0; i < nb_results; i++) {
+            if ((r_loop->results[i].RequestContext & PICOQUIC_RIO_TAG_MASK) == PICOQUIC_RIO_TAG_RECV) {
+                r_loop->nb_recv_pending--;
+            }
+            else {
+                r_loop->free_slots[r_loop->nb_free_slots++] = (int)(r_loop->results[i].RequestContext & ~PICOQUIC_RIO_TAG_MASK);
+            }
+        }
+    }
+}
+
+DWORD WINAPI picoquic_packet_loop_rio(LPVOID v_ctx)
+{
+    picoquic_network_thread_ctx_t* thread_ctx = (picoquic_network_thread_ctx_t*)v_ctx;
+    picoquic_quic_t* quic = thread_ctx->quic;
+    picoquic_packet_loop_param_t* param = thread_ctx->param;
+    picoquic_packet_loop_cb_fn loop_callback = thread_ctx->loop_callback;
+    void* loop_callback_ctx = thread_ctx->loop_callback_ctx;
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    int64_t delay_max = 10000000;
+    size_t send_msg_size = 0;
+    size_t send_buffer_size = param->socket_buffer_size;
+    size_t* send_msg_ptr = NULL;
+    picoquic_socket_ctx_t s_ctx[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    int nb_sockets = 0;
+    int nb_sockets_available = 0;
+    int nb_send_slots = (param->batch_depth > 1) ? param->batch_depth : (int)picoquic_get_packet_loop_send_max(quic);
+    picoquic_cnx_t* last_cnx = NULL;
+    picoquic_packet_loop_options_t options = { 0 };
+    packet_loop_system_call_duration_t sc_duration = { 0 };
+    picoquic_rio_loop_t* r_loop = NULL;
+    int recv_coalesced = 0;
+    int send_coalesced = 0;
+    size_t recv_data_size = PICOQUIC_MAX_JUMBO_PACKET_SIZE;
+
+    if (send_buffer_size == 0) {
+        send_buffer_size = 0xffff;
+    }
+    if (!param->do_not_use_gso) {
+        /* Size the buffers for the offloads that the system supports */
+        picoquic_sockloop_win_coalescing_test(&recv_coalesced, &send_coalesced);
+        if (send_coalesced) {
+            send_buffer_size = 0xFFFF;
+            send_msg_ptr = &send_msg_size;
+        }
+        if (recv_coalesced) {
+            recv_data_size = PICOQUIC_RIO_RECV_COALESCED_SIZE;
+        }
+    }
+    if (nb_send_slots > PICOQUIC_PACKET_LOOP_BATCH_MAX) {
+        nb_send_slots = PICOQUIC_PACKET_LOOP_BATCH_MAX;
+    }
+
+    if ((r_loop = picoquic_rio_loop_create(nb_send_slots, send_buffer_size, recv_data_size)) == NULL) {
+        DBG_PRINTF("%s", "Cannot initialize registered I/O, using the default loop.");
+        return picoquic_packet_loop_v3(v_ctx);
+    }
+
+    if (thread_ctx->thread_name != NULL) {
+        thread_ctx->thread_setname_fn(thread_ctx->thread_name);
+    }
+    picoquic_packet_loop_set_affinity(param);
+
+    memset(s_ctx, 0, sizeof(s_ctx));
+    for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+        s_ctx[i].reuse_port = (param->reuse_port) ? 1 : 0;
+        s_ctx[i].reuseport_steering_shards = param->reuseport_steering_shards;
+        s_ctx[i].use_rio = 1;
+        s_ctx[i].recv_buffer_size = recv_data_size;
+    }
+    if ((nb_sockets = picoquic_packet_loop_open_sockets(param->local_port,
+        param->local_af, param->socket_buffer_size,
+        param->extra_socket_required, param->do_not_use_gso, s_ctx)) <= 0) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else if (loop_callback != NULL) {
+        struct sockaddr_storage l_addr;
+        ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+
+        if (picoquic_store_loopback_addr(&l_addr, s_ctx[0].af, s_ctx[0].port) == 0) {
+            ret = loop_callback(quic, picoquic_packet_loop_port_update, loop_callback_ctx, &l_addr);
+        }
+        if (ret == 0 && options.provide_alt_port) {
+            int alt_sock = (nb_sockets > 2 && param->local_af == 0) ? 2 : 1;
+            uint16_t alt_port = s_ctx[alt_sock].port;
+            ret = loop_callback(quic, picoquic_packet_loop_alt_port, loop_callback_ctx, &alt_port);
+        }
+    }
+
+    if (ret == 0) {
+        nb_sockets_available = nb_sockets;
+        for (int i = 0; i < nb_sockets; i++) {
+            if (!s_ctx[i].supports_udp_send_coalesced) {
+                /* Only send trains if all the sockets support UDP_SEND_MSG_SIZE */
+                send_msg_ptr = NULL;
+            }
+        }
+        ret = picoquic_rio_open_queues(r_loop, s_ctx, nb_sockets);
+        for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+            for (int j = 0; ret == 0 && j < PICOQUIC_RIO_RECV_SLOTS; j++) {
+                ret = picoquic_rio_post_recv(r_loop, i, j, j < PICOQUIC_RIO_RECV_SLOTS - 1);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        thread_ctx->thread_is_ready = 1;
+    }
+    else {
+        DBG_PRINTF("%s", "Thread cannot run");
+    }
+
+    while (ret == 0 && !thread_ctx->thread_should_close) {
+        int64_t delta_t;
+        uint64_t previous_time;
+        size_t bytes_recv = 0;
+        size_t bytes_sent = 0;
+        size_t nb_packets_sent = 0;
+        int is_wake_up_event = 0;
+        int nb_results;
+        int recv_posted = 0;
+
+        current_time = picoquic_current_time();
+        delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
+        if (options.do_time_check) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = loop_callback(quic, picoquic_packet_loop_time_check, loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+        previous_time = current_time;
+        if ((nb_results = picoquic_rio_wait(r_loop, thread_ctx, delta_t, &is_wake_up_event)) < 0) {
+            ret = -1;
+            break;
+        }
+        current_time = picoquic_refresh_quic_time(quic);
+        if (delta_t > 0) {
+            /* The loop was blocked in the wait, and woke up */
+            picoquic_record_loop_wakeup(quic, current_time);
+        }
+        if (options.do_system_call_duration && delta_t == 0 &&
+            picoquic_packet_loop_monitor_system_call_duration(&sc_duration, current_time, previous_time)) {
+            ret = loop_callback(quic, picoquic_packet_loop_system_call_duration,
+                loop_callback_ctx, &sc_duration);
+        }
+
+        /* Process the batch of completions */
+        for (int i = 0; ret == 0 && i < nb_results; i++) {
+            RIORESULT* result = &r_loop->results[i];
+
+            if ((result->RequestContext & PICOQUIC_RIO_TAG_MASK) == PICOQUIC_RIO_TAG_RECV) {
+                int r = picoquic_rio_process_recv(quic, r_loop, s_ctx, nb_sockets_available, result,
+                    &last_cnx, current_time);
+                if (r < 0) {
+                    ret = -1;
+                }
+                else {
+                    bytes_recv += (size_t)r;
+                    recv_posted = 1;
+                }
+            }
+            else {
+                picoquic_rio_process_send(quic, r_loop, result, &send_msg_ptr, current_time);
+            }
+        }
+        if (ret == 0 && recv_posted) {
+            /* Commit the receives posted again while processing the batch */
+            for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+                if (!r_loop->rio.RIOReceive(r_loop->rq[i], NULL, 0, RIO_MSG_COMMIT_ONLY, NULL)) {
+                    DBG_PRINTF("Cannot commit the receives on socket %d, err=%d", i, WSAGetLastError());
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0 && is_wake_up_event && !thread_ctx->thread_should_close) {
+            picoquic_run_network_commands(thread_ctx);
+            ret = loop_callback(quic, picoquic_packet_loop_wake_up, loop_callback_ctx, NULL);
+        }
+        if (ret == 0 && bytes_recv > 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_receive, loop_callback_ctx, &bytes_recv);
+        }
+
+        if (ret == PICOQUIC_NO_ERROR_SIMULATE_NAT) {
+            if (param->extra_socket_required) {
+                /* Stop using the extra socket, as in picoquic_packet_loop_v3 */
+                nb_sockets_available = nb_sockets / 2;
+            }
+            ret = 0;
+        }
+
+        /* Prepare packets and post them as deferred sends, as long as send slots are available */
+        while (ret == 0 && nb_packets_sent < (size_t)nb_send_slots && r_loop->nb_free_slots > 0) {
+            int slot_index = r_loop->free_slots[r_loop->nb_free_slots - 1];
+            picoquic_rio_send_slot_t* slot = &r_loop->send_slots[slot_index];
+            int sock_err = 0;
+
+            slot->if_index = param->dest_if;
+            slot->send_msg_size = 0;
+            memset(&slot->addr_local, 0, sizeof(struct sockaddr_storage));
+
+            ret = picoquic_prepare_next_packet_ex(quic, current_time,
+                slot->buffer, r_loop->send_buffer_size, &slot->length,
+                &slot->addr_peer, &slot->addr_local, &slot->if_index, &slot->log_cid, &slot->cnx,
+                (send_msg_ptr == NULL) ? NULL : &slot->send_msg_size);
+
+            if (ret != 0 || slot->length == 0) {
+                break;
+            }
+            nb_packets_sent += (slot->send_msg_size == 0) ? 1 :
+                (slot->length + slot->send_msg_size - 1) / (slot->send_msg_size);
+            if (slot->length > param->send_length_max) {
+                param->send_length_max = slot->length;
+            }
+            bytes_sent += slot->length;
+
+            slot->fd = picoquic_packet_loop_get_send_socket(s_ctx, nb_sockets_available, param,
+                &slot->addr_peer, &slot->addr_local);
+            slot->socket_rank = -1;
+            for (int i = 0; i < nb_sockets; i++) {
+                if (slot->fd == s_ctx[i].fd) {
+                    slot->socket_rank = i;
+                    break;
+                }
+            }
+            if (slot->fd == INVALID_SOCKET || slot->socket_rank < 0) {
+                sock_err = -1;
+            }
+            else if (param->simulate_eio && slot->length > PICOQUIC_MAX_PACKET_SIZE) {
+                /* Test hook, simulating a driver that does not support GSO */
+                param->simulate_eio = 0;
+                sock_err = EIO;
+            }
+            else if ((sock_err = picoquic_rio_post_send(r_loop, slot_index)) == 0) {
+                r_loop->nb_free_slots--;
+            }
+            if (sock_err != 0) {
+                picoquic_packet_loop_send_error(quic, slot->cnx, &slot->log_cid, slot->fd,
+                    &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+                    slot->send_msg_size, -1, sock_err, &send_msg_ptr, current_time);
+            }
+        }
+
+        if (ret == 0) {
+            ret = picoquic_rio_commit_sends(r_loop);
+        }
+
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    thread_ctx->thread_is_ready = 0;
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        /* Normal termination requested by the application, returns no error */
+        ret = 0;
+    }
+
+    /* Make sure that the deferred sends are not left pending, then close
+     * the sockets, which cancels the posted requests. */
+    (void)picoquic_rio_commit_sends(r_loop);
+    for (int i = 0; i < nb_sockets; i++) {
+        picoquic_packet_loop_close_socket(&s_ctx[i]);
+    }
+    picoquic_rio_drain(r_loop);
+    picoquic_rio_loop_release(r_loop);
+
+    thread_ctx->return_code = ret;
+    thread_ctx->thread_is_closed = 1;
+    return (DWORD)ret;
+}
+#endif
@@ -0,0 +1,872 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Variant of the socket loop using io_uring.
+ *
+ * The loop keeps one multishot IORING_OP_RECVMSG request posted on each
+ * socket. The received datagrams are placed in buffers taken from a
+ * "provided buffer ring" registered for that socket, and the buffers are
+ * returned to the ring after the packets are processed. Outgoing packets
+ * are prepared in a pool of send slots and queued as IORING_OP_SENDMSG
+ * requests. A single call to io_uring_enter submits the queued requests
+ * and waits for the next completion or for the next wake up time.
+ *
+ * The wake up pipe of the network thread is monitored with a read request,
+ * re-armed after each completion.
+ *
+ * The code uses the raw system calls and the definitions in <linux/io_uring.h>,
+ * so there is no dependency on liburing. It requires a kernel supporting
+ * multishot recvmsg and provided buffer rings (Linux 6.0 or later). If the
+ * ring cannot be set up, the loop falls back to picoquic_packet_loop_v3.
+ */
+
+#if defined(__linux__) && defined(PICOQUIC_WITH_IO_URING)
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "picosocks.h"
+#include "picoquic.h"
+#include "picoquic_internal.h"
+#include "picoquic_packet_loop.h"
+#include "picoquic_unified_log.h"
+
+#define PICOQUIC_URING_ENTRIES 256
+#define PICOQUIC_URING_RECV_BUFFERS 64 /* Must be a power of 2 */
+#define PICOQUIC_URING_CMSG_SIZE 256
+#define PICOQUIC_URING_RECV_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + \
+    sizeof(struct sockaddr_storage) + PICOQUIC_URING_CMSG_SIZE + PICOQUIC_MAX_JUMBO_PACKET_SIZE)
+#define PICOQUIC_URING_DRAIN_TIMEOUT 100000
+
+/* The user data of each request documents the type of request and
+ * the socket or send slot to which it applies */
+#define PICOQUIC_URING_TAG_WAKE_UP 0x1000000000000000ull
+#define PICOQUIC_URING_TAG_RECV 0x2000000000000000ull
+#define PICOQUIC_URING_TAG_SEND 0x3000000000000000ull
+#define PICOQUIC_URING_TAG_CANCEL 0x4000000000000000ull
+#define PICOQUIC_URING_TAG_MASK 0xF000000000000000ull
+
+typedef struct st_picoquic_uring_t {
+    int ring_fd;
+    unsigned int features;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+} picoquic_uring_t;
+
+typedef struct st_picoquic_uring_socket_t {
+    struct msghdr msg;
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    uint8_t* buffers;
+    uint16_t bgid;
+    uint16_t buf_tail;
+    int is_registered;
+    int is_armed;
+} picoquic_uring_socket_t;
+
+typedef struct st_picoquic_uring_send_slot_t {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr_peer;
+    struct sockaddr_storage addr_local;
+    int if_index;
+    size_t length;
+    size_t send_msg_size;
+    SOCKET_TYPE fd;
+    picoquic_cnx_t* cnx;
+    picoquic_connection_id_t log_cid;
+    uint8_t* buffer;
+    char cmsg_buffer[PICOQUIC_URING_CMSG_SIZE];
+} picoquic_uring_send_slot_t;
+
+typedef struct st_picoquic_uring_loop_t {
+    picoquic_uring_t ring;
+    picoquic_uring_socket_t u_sock[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    int nb_sockets;
+    picoquic_uring_send_slot_t* send_slots;
+    int* free_slots;
+    int nb_send_slots;
+    int nb_free_slots;
+    uint8_t* send_buffers;
+    size_t send_buffer_size;
+    uint8_t wake_up_buffer[8];
+    int wake_up_armed;
+} picoquic_uring_loop_t;
+
+static int picoquic_uring_setup(picoquic_uring_t* ring, unsigned int entries)
+{
+    int ret = 0;
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(picoquic_uring_t));
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->ring_fd < 0) {
+        DBG_PRINTF("io_uring_setup fails, err=%d", errno);
+        ret = -1;
+    }
+    else if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+        DBG_PRINTF("%s", "io_uring does not support IORING_FEAT_EXT_ARG");
+        ret = -1;
+    }
+    else {
+        ring->features = params.features;
+        ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (ring->cq_ring_size > ring->sq_ring_size) {
+                ring->sq_ring_size = ring->cq_ring_size;
+            }
+            ring->cq_ring_size = ring->sq_ring_size;
+        }
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+            ring->sq_ring = NULL;
+            ret = -1;
+        }
+        else if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            ring->cq_ring = ring->sq_ring;
+        }
+        else {
+            ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+            if (ring->cq_ring == MAP_FAILED) {
+                ring->cq_ring = NULL;
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+            ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+            if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            uint8_t* sq = (uint8_t*)ring->sq_ring;
+            uint8_t* cq = (uint8_t*)ring->cq_ring;
+
+            ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+            ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+            ring->sq_mask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+            ring->sq_entries = *(unsigned int*)(sq + params.sq_off.ring_entries);
+            ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+            ring->sqe_tail = *ring->sq_tail;
+            ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+            ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+            ring->cq_mask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+            ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+        }
+        else {
+            DBG_PRINTF("Cannot map the io_uring queues, err=%d", errno);
+        }
+    }
+    return ret;
+}
+
+static void picoquic_uring_release(picoquic_uring_t* ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    ring->cq_ring = NULL;
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        ring->sq_ring = NULL;
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+    }
+}
+
+/* Submit the queued requests. If min_complete is not zero, wait until
+ * at least that many completions are available, or until the delay expires.
+ * Returns 0 on success, -1 on error. */
+static int picoquic_uring_enter(picoquic_uring_t* ring, unsigned int min_complete, int64_t delta_t)
+{
+    int ret = 0;
+    unsigned int flags = 0;
+    unsigned int to_submit;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0) {
+        if (delta_t < 0) {
+            delta_t = 0;
+        }
+        else if (delta_t > 10000000) {
+            delta_t = 10000000;
+        }
+        ts.tv_sec = delta_t / 1000000;
+        ts.tv_nsec = (delta_t % 1000000) * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+
+    if (to_submit > 0 || min_complete > 0) {
+        if (syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete, flags,
+            (flags != 0) ? &arg : NULL, sizeof(arg)) < 0) {
+            if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                DBG_PRINTF("io_uring_enter fails, err=%d", errno);
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+static struct io_uring_sqe* picoquic_uring_get_sqe(picoquic_uring_t* ring)
+{
+    struct io_uring_sqe* sqe = NULL;
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        /* The submission queue is full. Submit the pending entries and try again */
+        (void)picoquic_uring_enter(ring, 0, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+    if (ring->sqe_tail - head < ring->sq_entries) {
+        unsigned int index = ring->sqe_tail & ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        ring->sq_array[index] = index;
+        ring->sqe_tail++;
+    }
+    return sqe;
+}
+
+static void picoquic_uring_recycle_buffer(picoquic_uring_socket_t* u_sock, uint16_t bid)
+{
+    struct io_uring_buf* buf = &u_sock->buf_ring->bufs[u_sock->buf_tail & (PICOQUIC_URING_RECV_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(u_sock->buffers + (size_t)bid * PICOQUIC_URING_RECV_BUFFER_SIZE);
+    buf->len = (uint32_t)PICOQUIC_URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    u_sock->buf_tail++;
+    __atomic_store_n(&u_sock->buf_ring->tail, u_sock->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int picoquic_uring_socket_init(picoquic_uring_t* ring, picoquic_uring_socket_t* u_sock, uint16_t bgid)
+{
+    int ret = 0;
+    struct io_uring_buf_reg reg;
+
+    memset(u_sock, 0, sizeof(picoquic_uring_socket_t));
+    u_sock->bgid = bgid;
+    u_sock->buf_ring_size = PICOQUIC_URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    u_sock->buf_ring = (struct io_uring_buf_ring*)mmap(NULL, u_sock->buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (u_sock->buf_ring == MAP_FAILED) {
+        u_sock->buf_ring = NULL;
+        ret = -1;
+    }
+    else if ((u_sock->buffers = (uint8_t*)malloc(PICOQUIC_URING_RECV_BUFFERS * PICOQUIC_URING_RECV_BUFFER_SIZE)) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)u_sock->buf_ring;
+        reg.ring_entries = PICOQUIC_URING_RECV_BUFFERS;
+        reg.bgid = bgid;
+        if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            DBG_PRINTF("Cannot register buffer ring %d, err=%d", bgid, errno);
+            ret = -1;
+        }
+        else {
+            u_sock->is_registered = 1;
+            for (uint16_t bid = 0; bid < PICOQUIC_URING_RECV_BUFFERS; bid++) {
+                picoquic_uring_recycle_buffer(u_sock, bid);
+            }
+            /* The recvmsg template only documents the length of the name
+             * and control areas placed in front of the payload. */
+            u_sock->msg.msg_namelen = sizeof(struct sockaddr_storage);
+            u_sock->msg.msg_controllen = PICOQUIC_URING_CMSG_SIZE;
+        }
+    }
+    return ret;
+}
+
+static void picoquic_uring_socket_release(picoquic_uring_socket_t* u_sock)
+{
+    if (u_sock->buf_ring != NULL) {
+        munmap(u_sock->buf_ring, u_sock->buf_ring_size);
+        u_sock->buf_ring = NULL;
+    }
+    if (u_sock->buffers != NULL) {
+        free(u_sock->buffers);
+        u_sock->buffers = NULL;
+    }
+}
+
+static int picoquic_uring_arm_recv(picoquic_uring_loop_t* u_loop, picoquic_socket_ctx_t* s_ctx, int socket_rank)
+{
+    int ret = 0;
+    picoquic_uring_socket_t* u_sock = &u_loop->u_sock[socket_rank];
+    struct io_uring_sqe* sqe = picoquic_uring_get_sqe(&u_loop->ring);
+
+    if (sqe == NULL) {
+        ret = -1;
+    }
+    else {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = s_ctx->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&u_sock->msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = u_sock->bgid;
+        sqe->user_data = PICOQUIC_URING_TAG_RECV | (uint64_t)socket_rank;
+        u_sock->is_armed = 1;
+    }
+    return ret;
+}
+
+static int picoquic_uring_arm_wake_up(picoquic_uring_loop_t* u_loop, picoquic_network_thread_ctx_t* thread_ctx)
+{
+    int ret = 0;
+    struct io_uring_sqe* sqe = picoquic_uring_get_sqe(&u_loop->ring);
+
+    if (sqe == NULL) {
+        ret = -1;
+    }
+    else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = thread_ctx->wake_up_pipe_fd[0];
+        sqe->addr = (uint64_t)(uintptr_t)u_loop->wake_up_buffer;
+        sqe->len = sizeof(u_loop->wake_up_buffer);
+        sqe->user_data = PICOQUIC_URING_TAG_WAKE_UP;
+        u_loop->wake_up_armed = 1;
+    }
+    return ret;
+}
+
+static void picoquic_uring_loop_release(picoquic_uring_loop_t* u_loop)
+{
+    picoquic_uring_release(&u_loop->ring);
+    for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+        picoquic_uring_socket_release(&u_loop->u_sock[i]);
+    }
+    if (u_loop->send_slots != NULL) {
+        free(u_loop->send_slots);
+    }
+    if (u_loop->free_slots != NULL) {
+        free(u_loop->free_slots);
+    }
+    if (u_loop->send_buffers != NULL) {
+        free(u_loop->send_buffers);
+    }
+    free(u_loop);
+}
+
+static picoquic_uring_loop_t* picoquic_uring_loop_create(int nb_send_slots, size_t send_buffer_size)
+{
+    picoquic_uring_loop_t* u_loop = (picoquic_uring_loop_t*)malloc(sizeof(picoquic_uring_loop_t));
+
+    if (u_loop != NULL) {
+        int ret = 0;
+        memset(u_loop, 0, sizeof(picoquic_uring_loop_t));
+        u_loop->ring.ring_fd = -1;
+        u_loop->nb_send_slots = nb_send_slots;
+        u_loop->send_buffer_size = send_buffer_size;
+
+        if (picoquic_uring_setup(&u_loop->ring, PICOQUIC_URING_ENTRIES) != 0) {
+            ret = -1;
+        }
+        else {
+            u_loop->send_slots = (picoquic_uring_send_slot_t*)malloc(nb_send_slots * sizeof(picoquic_uring_send_slot_t));
+            u_loop->free_slots = (int*)malloc(nb_send_slots * sizeof(int));
+            u_loop->send_buffers = (uint8_t*)malloc(nb_send_slots * send_buffer_size);
+            if (u_loop->send_slots == NULL || u_loop->free_slots == NULL || u_loop->send_buffers == NULL) {
+                ret = -1;
+            }
+            else {
+                memset(u_loop->send_slots, 0, nb_send_slots * sizeof(picoquic_uring_send_slot_t));
+                for (int i = 0; i < nb_send_slots; i++) {
+                    u_loop->send_slots[i].buffer = u_loop->send_buffers + i * send_buffer_size;
+                    u_loop->free_slots[i] = i;
+                }
+                u_loop->nb_free_slots = nb_send_slots;
+            }
+        }
+        for (int i = 0; ret == 0 && i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+            ret = picoquic_uring_socket_init(&u_loop->ring, &u_loop->u_sock[i], (uint16_t)i);
+        }
+        if (ret != 0) {
+            picoquic_uring_loop_release(u_loop);
+            u_loop = NULL;
+        }
+    }
+    return u_loop;
+}
+
+/* Queue a sendmsg request for the packet prepared in the slot. */
+static int picoquic_uring_queue_send(picoquic_uring_loop_t* u_loop, int slot_index)
+{
+    int ret = 0;
+    picoquic_uring_send_slot_t* slot = &u_loop->send_slots[slot_index];
+    struct io_uring_sqe* sqe = picoquic_uring_get_sqe(&u_loop->ring);
+
+    if (sqe == NULL) {
+        ret = -1;
+    }
+    else {
+        slot->iov.iov_base = slot->buffer;
+        slot->iov.iov_len = slot->length;
+        memset(&slot->msg, 0, sizeof(struct msghdr));
+        slot->msg.msg_name = &slot->addr_peer;
+        slot->msg.msg_namelen = picoquic_addr_length((struct sockaddr*)&slot->addr_peer);
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+        slot->msg.msg_control = slot->cmsg_buffer;
+        slot->msg.msg_controllen = sizeof(slot->cmsg_buffer);
+        picoquic_socks_cmsg_format(&slot->msg, slot->length, slot->send_msg_size,
+            (struct sockaddr*)&slot->addr_local, slot->if_index);
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = slot->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+        sqe->len = 1;
+        sqe->user_data = PICOQUIC_URING_TAG_SEND | (uint64_t)slot_index;
+    }
+    return ret;
+}
+
+/* Process one multishot receive completion, and add the number of bytes
+ * received to bytes_recv. Returns the error code of the stack, or -1 if
+ * the request failed for a reason other than lack of buffers. */
+static int picoquic_uring_process_recv(picoquic_quic_t* quic, picoquic_uring_loop_t* u_loop,
+    picoquic_socket_ctx_t* s_ctx, int nb_sockets_available, struct io_uring_cqe* cqe,
+    picoquic_cnx_t** last_cnx, size_t* bytes_recv, uint64_t current_time)
+{
+    int ret = 0;
+    int socket_rank = (int)(cqe->user_data & ~PICOQUIC_URING_TAG_MASK);
+    picoquic_uring_socket_t* u_sock = &u_loop->u_sock[socket_rank];
+
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+        /* The multishot request has terminated, and will be posted again. */
+        u_sock->is_armed = 0;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        uint8_t* buffer = u_sock->buffers + (size_t)bid * PICOQUIC_URING_RECV_BUFFER_SIZE;
+
+        if (cqe->res > 0 && socket_rank < nb_sockets_available) {
+            struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buffer;
+            uint8_t* name = buffer + sizeof(struct io_uring_recvmsg_out);
+            uint8_t* control = name + u_sock->msg.msg_namelen;
+            uint8_t* payload = control + u_sock->msg.msg_controllen;
+            struct sockaddr_storage addr_from;
+            struct sockaddr_storage addr_to;
+            struct msghdr cmsg_hdr;
+            int if_index_to = 0;
+            unsigned char received_ecn = 0;
+
+            if ((out->flags & MSG_TRUNC) == 0 && out->namelen <= sizeof(struct sockaddr_storage)) {
+                memset(&addr_from, 0, sizeof(addr_from));
+                memcpy(&addr_from, name, out->namelen);
+                memset(&addr_to, 0, sizeof(addr_to));
+                memset(&cmsg_hdr, 0, sizeof(cmsg_hdr));
+                cmsg_hdr.msg_control = control;
+                cmsg_hdr.msg_controllen = out->controllen;
+                picoquic_socks_cmsg_parse(&cmsg_hdr, &addr_to, &if_index_to, &received_ecn, NULL);
+                /* Document incoming port */
+                if (addr_to.ss_family == AF_INET6) {
+                    ((struct sockaddr_in6*)&addr_to)->sin6_port = s_ctx[socket_rank].n_port;
+                }
+                else if (addr_to.ss_family == AF_INET) {
+                    ((struct sockaddr_in*)&addr_to)->sin_port = s_ctx[socket_rank].n_port;
+                }
+                ret = picoquic_incoming_packet_ex(quic, payload, out->payloadlen,
+                    (struct sockaddr*)&addr_from, (struct sockaddr*)&addr_to, if_index_to, received_ecn,
+                    last_cnx, current_time);
+                *bytes_recv += out->payloadlen;
+            }
+        }
+        picoquic_uring_recycle_buffer(u_sock, bid);
+    }
+    else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+        DBG_PRINTF("Multishot recvmsg on socket %d fails, err=%d", socket_rank, -cqe->res);
+        ret = -1;
+    }
+    return ret;
+}
+
+static void picoquic_uring_process_send(picoquic_quic_t* quic, picoquic_uring_loop_t* u_loop,
+    struct io_uring_cqe* cqe, size_t** send_msg_ptr, uint64_t current_time)
+{
+    int slot_index = (int)(cqe->user_data & ~PICOQUIC_URING_TAG_MASK);
+    picoquic_uring_send_slot_t* slot = &u_loop->send_slots[slot_index];
+
+    if (cqe->res < 0) {
+        picoquic_cnx_t* cnx = picoquic_packet_loop_check_cnx(quic, slot->cnx, &slot->log_cid);
+        picoquic_packet_loop_send_error(quic, cnx, &slot->log_cid, slot->fd,
+            &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+            slot->send_msg_size, -1, -cqe->res, send_msg_ptr, current_time);
+    }
+    u_loop->free_slots[u_loop->nb_free_slots++] = slot_index;
+}
+
+/* Before releasing the buffers, cancel the pending requests and wait until
+ * all of them have completed, so the kernel does not access memory after it is freed. */
+static void picoquic_uring_drain(picoquic_uring_loop_t* u_loop)
+{
+    struct io_uring_sqe* sqe;
+    uint64_t start_time = picoquic_current_time();
+
+    if ((sqe = picoquic_uring_get_sqe(&u_loop->ring)) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = PICOQUIC_URING_TAG_CANCEL;
+    }
+
+    while (picoquic_current_time() - start_time < PICOQUIC_URING_DRAIN_TIMEOUT) {
+        int is_pending = u_loop->wake_up_armed || u_loop->nb_free_slots < u_loop->nb_send_slots;
+        unsigned int head;
+        unsigned int tail;
+
+        for (int i = 0; !is_pending && i < u_loop->nb_sockets; i++) {
+            is_pending = u_loop->u_sock[i].is_armed;
+        }
+        if (!is_pending || picoquic_uring_enter(&u_loop->ring, 1, 10000) != 0) {
+            break;
+        }
+        head = *u_loop->ring.cq_head;
+        tail = __atomic_load_n(u_loop->ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &u_loop->ring.cqes[head & u_loop->ring.cq_mask];
+            uint64_t tag = cqe->user_data & PICOQUIC_URING_TAG_MASK;
+
+            if (tag == PICOQUIC_URING_TAG_WAKE_UP) {
+                u_loop->wake_up_armed = 0;
+            }
+            else if (tag == PICOQUIC_URING_TAG_RECV) {
+                int socket_rank = (int)(cqe->user_data & ~PICOQUIC_URING_TAG_MASK);
+                if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+                    u_loop->u_sock[socket_rank].is_armed = 0;
+                }
+            }
+            else if (tag == PICOQUIC_URING_TAG_SEND) {
+                u_loop->free_slots[u_loop->nb_free_slots++] = (int)(cqe->user_data & ~PICOQUIC_URING_TAG_MASK);
+            }
+            head++;
+        }
+        __atomic_store_n(u_loop->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+void* picoquic_packet_loop_uring(void* v_ctx)
+{
+    picoquic_network_thread_ctx_t* thread_ctx = (picoquic_network_thread_ctx_t*)v_ctx;
+    picoquic_quic_t* quic = thread_ctx->quic;
+    picoquic_packet_loop_param_t* param = thread_ctx->param;
+    picoquic_packet_loop_cb_fn loop_callback = thread_ctx->loop_callback;
+    void* loop_callback_ctx = thread_ctx->loop_callback_ctx;
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    int64_t delay_max = 10000000;
+    size_t send_msg_size = 0;
+    size_t send_buffer_size = param->socket_buffer_size;
+    size_t* send_msg_ptr = NULL;
+    picoquic_socket_ctx_t s_ctx[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    int nb_sockets = 0;
+    int nb_sockets_available = 0;
+    int nb_send_slots = (param->batch_depth > 1) ? param->batch_depth : (int)picoquic_get_packet_loop_send_max(quic);
+    picoquic_cnx_t* last_cnx = NULL;
+    picoquic_packet_loop_options_t options = { 0 };
+    packet_loop_system_call_duration_t sc_duration = { 0 };
+    picoquic_uring_loop_t* u_loop = NULL;
+
+    if (send_buffer_size == 0) {
+        send_buffer_size = 0xffff;
+    }
+    if (!param->do_not_use_gso) {
+        send_buffer_size = 0xFFFF;
+        send_msg_ptr = &send_msg_size;
+    }
+    if (nb_send_slots > PICOQUIC_PACKET_LOOP_BATCH_MAX) {
+        nb_send_slots = PICOQUIC_PACKET_LOOP_BATCH_MAX;
+    }
+
+    if ((u_loop = picoquic_uring_loop_create(nb_send_slots, send_buffer_size)) == NULL) {
+        DBG_PRINTF("%s", "Cannot initialize io_uring, using the default loop.");
+        return picoquic_packet_loop_v3(v_ctx);
+    }
+
+    if (thread_ctx->thread_name != NULL) {
+        thread_ctx->thread_setname_fn(thread_ctx->thread_name);
+    }
+    picoquic_packet_loop_set_affinity(param);
+
+    memset(s_ctx, 0, sizeof(s_ctx));
+    for (int i = 0; i < PICOQUIC_PACKET_LOOP_SOCKETS_MAX; i++) {
+        s_ctx[i].reuse_port = (param->reuse_port) ? 1 : 0;
+        s_ctx[i].reuseport_steering_shards = param->reuseport_steering_shards;
+    }
+    if ((nb_sockets = picoquic_packet_loop_open_sockets(param->local_port,
+        param->local_af, param->socket_buffer_size,
+        param->extra_socket_required, param->do_not_use_gso, s_ctx)) <= 0) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else if (loop_callback != NULL) {
+        struct sockaddr_storage l_addr;
+        ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+
+        if (picoquic_store_loopback_addr(&l_addr, s_ctx[0].af, s_ctx[0].port) == 0) {
+            ret = loop_callback(quic, picoquic_packet_loop_port_update, loop_callback_ctx, &l_addr);
+        }
+        if (ret == 0 && options.provide_alt_port) {
+            int alt_sock = (nb_sockets > 2 && param->local_af == 0) ? 2 : 1;
+            uint16_t alt_port = s_ctx[alt_sock].port;
+            ret = loop_callback(quic, picoquic_packet_loop_alt_port, loop_callback_ctx, &alt_port);
+        }
+    }
+
+    if (ret == 0) {
+        nb_sockets_available = nb_sockets;
+        u_loop->nb_sockets = nb_sockets;
+        for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+            ret = picoquic_uring_arm_recv(u_loop, &s_ctx[i], i);
+        }
+        if (ret == 0 && thread_ctx->wake_up_defined) {
+            ret = picoquic_uring_arm_wake_up(u_loop, thread_ctx);
+        }
+    }
+
+    if (ret == 0) {
+        thread_ctx->thread_is_ready = 1;
+    }
+    else {
+        DBG_PRINTF("%s", "Thread cannot run");
+    }
+
+    while (ret == 0 && !thread_ctx->thread_should_close) {
+        int64_t delta_t;
+        uint64_t previous_time;
+        size_t bytes_recv = 0;
+        size_t bytes_sent = 0;
+        size_t nb_packets_sent = 0;
+        int is_wake_up_event = 0;
+        unsigned int head;
+        unsigned int tail;
+
+        current_time = picoquic_current_time();
+        delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
+        if (options.do_time_check && loop_callback != NULL) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = loop_callback(quic, picoquic_packet_loop_time_check, loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+        previous_time = current_time;
+        /* Submit the queued requests and wait for completions */
+        if (picoquic_uring_enter(&u_loop->ring, 1, delta_t) != 0) {
+            ret = (thread_ctx->thread_should_close) ? PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP : -1;
+            break;
+        }
+        current_time = picoquic_refresh_quic_time(quic);
+        if (delta_t > 0) {
+            /* The loop was blocked in the wait, and woke up */
+            picoquic_record_loop_wakeup(quic, current_time);
+        }
+        if (options.do_system_call_duration && delta_t == 0 &&
+            picoquic_packet_loop_monitor_system_call_duration(&sc_duration, current_time, previous_time)) {
+            ret = loop_callback(quic, picoquic_packet_loop_system_call_duration,
+                loop_callback_ctx, &sc_duration);
+        }
+
+        /* Process the completions */
+        head = *u_loop->ring.cq_head;
+        tail = __atomic_load_n(u_loop->ring.cq_tail, __ATOMIC_ACQUIRE);
+        picoquic_receive_batch_start(quic);
+        while (ret == 0 && head != tail) {
+            struct io_uring_cqe* cqe = &u_loop->ring.cqes[head & u_loop->ring.cq_mask];
+            uint64_t tag = cqe->user_data & PICOQUIC_URING_TAG_MASK;
+
+            if (tag == PICOQUIC_URING_TAG_RECV) {
+                ret = picoquic_uring_process_recv(quic, u_loop, s_ctx, nb_sockets_available, cqe,
+                    &last_cnx, &bytes_recv, current_time);
+            }
+            else if (tag == PICOQUIC_URING_TAG_SEND) {
+                picoquic_uring_process_send(quic, u_loop, cqe, &send_msg_ptr, current_time);
+            }
+            else if (tag == PICOQUIC_URING_TAG_WAKE_UP) {
+                u_loop->wake_up_armed = 0;
+                if (cqe->res <= 0) {
+                    /* The pipe is closed when the thread is deleted. */
+                    ret = (thread_ctx->thread_should_close) ? PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP : -1;
+                    DBG_PRINTF("Error: read pipe returns %d\n", (cqe->res == 0) ? EPIPE : -cqe->res);
+                }
+                else {
+                    is_wake_up_event = 1;
+                }
+            }
+            head++;
+        }
+        __atomic_store_n(u_loop->ring.cq_head, head, __ATOMIC_RELEASE);
+        picoquic_receive_batch_end(quic);
+
+        /* Post again the requests that have terminated */
+        for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+            if (!u_loop->u_sock[i].is_armed) {
+                ret = picoquic_uring_arm_recv(u_loop, &s_ctx[i], i);
+            }
+        }
+        if (ret == 0 && is_wake_up_event && !thread_ctx->thread_should_close) {
+            if ((ret = picoquic_uring_arm_wake_up(u_loop, thread_ctx)) == 0) {
+                picoquic_run_network_commands(thread_ctx);
+                if (loop_callback != NULL) {
+                    ret = loop_callback(quic, picoquic_packet_loop_wake_up, loop_callback_ctx, NULL);
+                }
+            }
+        }
+        if (ret == 0 && bytes_recv > 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_receive, loop_callback_ctx, &bytes_recv);
+        }
+
+        if (ret == PICOQUIC_NO_ERROR_SIMULATE_NAT) {
+            if (param->extra_socket_required) {
+                /* Stop using the extra socket, as in picoquic_packet_loop_v3 */
+                nb_sockets_available = nb_sockets / 2;
+            }
+            ret = 0;
+        }
+
+        /* Prepare packets and queue them for sending, as long as send slots are available */
+        while (ret == 0 && nb_packets_sent < (size_t)nb_send_slots && u_loop->nb_free_slots > 0) {
+            int slot_index = u_loop->free_slots[u_loop->nb_free_slots - 1];
+            picoquic_uring_send_slot_t* slot = &u_loop->send_slots[slot_index];
+
+            slot->if_index = param->dest_if;
+            slot->send_msg_size = 0;
+            memset(&slot->addr_local, 0, sizeof(struct sockaddr_storage));
+
+            ret = picoquic_prepare_next_packet_ex(quic, current_time,
+                slot->buffer, u_loop->send_buffer_size, &slot->length,
+                &slot->addr_peer, &slot->addr_local, &slot->if_index, &slot->log_cid, &slot->cnx,
+                (send_msg_ptr == NULL) ? NULL : &slot->send_msg_size);
+
+            if (ret != 0 || slot->length == 0) {
+                break;
+            }
+            nb_packets_sent += (slot->send_msg_size == 0) ? 1 :
+                (slot->length + slot->send_msg_size - 1) / (slot->send_msg_size);
+            if (slot->length > param->send_length_max) {
+                param->send_length_max = slot->length;
+            }
+            bytes_sent += slot->length;
+
+            slot->fd = picoquic_packet_loop_get_send_socket(s_ctx, nb_sockets_available, param,
+                &slot->addr_peer, &slot->addr_local);
+            if (slot->fd == INVALID_SOCKET) {
+                picoquic_packet_loop_send_error(quic, slot->cnx, &slot->log_cid, slot->fd,
+                    &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+                    slot->send_msg_size, -1, -1, &send_msg_ptr, current_time);
+            }
+            else if (param->simulate_eio && slot->length > PICOQUIC_MAX_PACKET_SIZE) {
+                /* Test hook, simulating a driver that does not support GSO */
+                param->simulate_eio = 0;
+                picoquic_packet_loop_send_error(quic, slot->cnx, &slot->log_cid, slot->fd,
+                    &slot->addr_peer, &slot->addr_local, slot->if_index, slot->buffer, slot->length,
+                    slot->send_msg_size, -1, EIO, &send_msg_ptr, current_time);
+            }
+            else if ((ret = picoquic_uring_queue_send(u_loop, slot_index)) == 0) {
+                u_loop->nb_free_slots--;
+            }
+        }
+
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    thread_ctx->thread_is_ready = 0;
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        /* Normal termination requested by the application, returns no error */
+        ret = 0;
+    }
+
+    picoquic_uring_drain(u_loop);
+
+    /* Close the sockets */
+    for (int i = 0; i < nb_sockets; i++) {
+        picoquic_packet_loop_close_socket(&s_ctx[i]);
+    }
+
+    picoquic_uring_loop_release(u_loop);
+
+    thread_ctx->return_code = ret;
+    thread_ctx->thread_is_closed = 1;
+    if (thread_ctx->is_threaded) {
+        pthread_exit((void*)&thread_ctx->return_code);
+    }
+    return(NULL);
+}
+#elif !defined(_WINDOWS)
+#include "picoquic_packet_loop.h"
+
+/* io_uring is not available in this build. Use the default loop. */
+void* picoquic_packet_loop_uring(void* v_ctx)
+{
+    return picoquic_packet_loop_v3(v_ctx);
+}
+#endif
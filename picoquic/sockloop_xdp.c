@@ -0,0 +1,682 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* AF_XDP packet I/O provider, see picoquic_xdp_param_t in picoquic_packet_loop.h.
+ *
+ * The provider registers a UMEM of fixed size frames with an AF_XDP socket,
+ * bound to one queue of a network interface. Half of the frames are posted
+ * in the fill ring and receive the packets redirected by the XDP program
+ * of the application. The other half are used for sending: the loop prepares
+ * each packet directly in a frame, after a headroom in which the provider
+ * writes the Ethernet, IP and UDP headers, and the frames are returned by
+ * the completion ring after transmission. With XDP_ZEROCOPY, the NIC reads
+ * and writes the UMEM directly.
+ *
+ * The code uses the raw system calls and the definitions in <linux/if_xdp.h>,
+ * so there is no dependency on libxdp or libbpf. It does not load the XDP
+ * program, which is left to the application, see picoquic_xdp_param_t.
+ * Received packets that are not UDP packets for the local port, or that carry
+ * IPv6 extension headers or IPv4 fragments, are dropped.
+ */
+
+#if defined(__linux__) && defined(PICOQUIC_WITH_AF_XDP)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Required for ppoll */
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_xdp.h>
+
+#include "picosocks.h"
+#include "picoquic.h"
+#include "picoquic_internal.h"
+#include "picoquic_packet_loop.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define PICOQUIC_XDP_FRAME_SIZE 4096
+#define PICOQUIC_XDP_NB_FRAMES_DEFAULT 4096
+#define PICOQUIC_XDP_NB_FRAMES_MIN 64
+#define PICOQUIC_XDP_HEADROOM 64 /* Room for Ethernet (14), IPv6 (40) and UDP (8) headers */
+#define PICOQUIC_XDP_ETH_HEADER 14
+#define PICOQUIC_XDP_IPV4_HEADER 20
+#define PICOQUIC_XDP_IPV6_HEADER 40
+#define PICOQUIC_XDP_UDP_HEADER 8
+#define PICOQUIC_XDP_HANDLE_TX 0x8000000000000000ull
+
+typedef struct st_picoquic_xdp_ring_t {
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    void* desc;
+    uint32_t mask;
+    uint32_t size;
+    void* map;
+    size_t map_size;
+} picoquic_xdp_ring_t;
+
+typedef struct st_picoquic_xdp_ctx_t {
+    picoquic_xdp_param_t* xdp_param;
+    int fd;
+    int wake_up_fd;
+    uint16_t n_port;
+    uint8_t* umem;
+    size_t umem_size;
+    uint32_t nb_frames;
+    picoquic_xdp_ring_t fill;
+    picoquic_xdp_ring_t comp;
+    picoquic_xdp_ring_t rx;
+    picoquic_xdp_ring_t tx;
+    uint64_t* free_frames;
+    uint32_t nb_free_frames;
+    uint8_t last_peer_mac[6];
+    int has_peer_mac;
+} picoquic_xdp_ctx_t;
+
+static int picoquic_xdp_ring_map(int fd, picoquic_xdp_ring_t* ring, struct xdp_ring_offset* off,
+    uint32_t size, size_t desc_size, off_t pgoff)
+{
+    int ret = 0;
+
+    ring->map_size = off->desc + (size_t)size * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        ret = -1;
+    }
+    else {
+        ring->producer = (uint32_t*)((uint8_t*)ring->map + off->producer);
+        ring->consumer = (uint32_t*)((uint8_t*)ring->map + off->consumer);
+        ring->flags = (uint32_t*)((uint8_t*)ring->map + off->flags);
+        ring->desc = (uint8_t*)ring->map + off->desc;
+        ring->size = size;
+        ring->mask = size - 1;
+    }
+    return ret;
+}
+
+static void picoquic_xdp_ring_unmap(picoquic_xdp_ring_t* ring)
+{
+    if (ring->map != NULL) {
+        (void)munmap(ring->map, ring->map_size);
+        ring->map = NULL;
+    }
+}
+
+/* Number of entries that the application can produce in a fill or tx ring */
+static uint32_t picoquic_xdp_ring_free(picoquic_xdp_ring_t* ring)
+{
+    uint32_t cons = __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE);
+    return ring->size - (*ring->producer - cons);
+}
+
+/* Number of entries that the application can consume in an rx or completion ring */
+static uint32_t picoquic_xdp_ring_available(picoquic_xdp_ring_t* ring)
+{
+    uint32_t prod = __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE);
+    return prod - *ring->consumer;
+}
+
+static void picoquic_xdp_fill_frame(picoquic_xdp_ctx_t* xdp, uint64_t frame)
+{
+    uint32_t prod = *xdp->fill.producer;
+
+    if (picoquic_xdp_ring_free(&xdp->fill) > 0) {
+        ((uint64_t*)xdp->fill.desc)[prod & xdp->fill.mask] = frame;
+        __atomic_store_n(xdp->fill.producer, prod + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Move the frames of completed transmissions to the free list */
+static void picoquic_xdp_reclaim(picoquic_xdp_ctx_t* xdp)
+{
+    uint32_t nb = picoquic_xdp_ring_available(&xdp->comp);
+    uint32_t cons = *xdp->comp.consumer;
+
+    for (uint32_t i = 0; i < nb && xdp->nb_free_frames < xdp->nb_frames; i++) {
+        uint64_t addr = ((uint64_t*)xdp->comp.desc)[(cons + i) & xdp->comp.mask];
+        xdp->free_frames[xdp->nb_free_frames++] = addr & ~((uint64_t)PICOQUIC_XDP_FRAME_SIZE - 1);
+    }
+    if (nb > 0) {
+        __atomic_store_n(xdp->comp.consumer, cons + nb, __ATOMIC_RELEASE);
+    }
+}
+
+static void picoquic_xdp_close(void* io_ctx)
+{
+    picoquic_xdp_ctx_t* xdp = (picoquic_xdp_ctx_t*)io_ctx;
+
+    if (xdp != NULL) {
+        picoquic_xdp_ring_unmap(&xdp->rx);
+        picoquic_xdp_ring_unmap(&xdp->tx);
+        picoquic_xdp_ring_unmap(&xdp->fill);
+        picoquic_xdp_ring_unmap(&xdp->comp);
+        if (xdp->fd >= 0) {
+            (void)close(xdp->fd);
+        }
+        if (xdp->xdp_param != NULL) {
+            xdp->xdp_param->xsk_fd = -1;
+        }
+        if (xdp->umem != NULL) {
+            (void)munmap(xdp->umem, xdp->umem_size);
+        }
+        if (xdp->free_frames != NULL) {
+            free(xdp->free_frames);
+        }
+        free(xdp);
+    }
+}
+
+static int picoquic_xdp_open(picoquic_packet_loop_param_t* param, void* provider_param, int wake_up_fd,
+    void** io_ctx, struct sockaddr_storage* local_addr)
+{
+    int ret = 0;
+    picoquic_xdp_param_t* xdp_param = (picoquic_xdp_param_t*)provider_param;
+    picoquic_xdp_ctx_t* xdp = NULL;
+    uint32_t nb_frames = PICOQUIC_XDP_NB_FRAMES_DEFAULT;
+    uint32_t ring_size;
+
+    *io_ctx = NULL;
+    (void)local_addr;
+
+    if (xdp_param == NULL || xdp_param->if_index <= 0 || param->local_port == 0) {
+        DBG_PRINTF("%s", "AF_XDP requires an interface index and a local port");
+        return PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    if (xdp_param->nb_frames != 0) {
+        /* Round down to a power of 2, so the rings can be indexed with a mask */
+        nb_frames = PICOQUIC_XDP_NB_FRAMES_MIN;
+        while (2 * nb_frames <= xdp_param->nb_frames) {
+            nb_frames *= 2;
+        }
+    }
+    ring_size = nb_frames / 2;
+
+    if ((xdp = (picoquic_xdp_ctx_t*)malloc(sizeof(picoquic_xdp_ctx_t))) == NULL) {
+        return PICOQUIC_ERROR_MEMORY;
+    }
+    memset(xdp, 0, sizeof(picoquic_xdp_ctx_t));
+    xdp->xdp_param = xdp_param;
+    xdp->wake_up_fd = wake_up_fd;
+    xdp->n_port = htons(param->local_port);
+    xdp->nb_frames = nb_frames;
+    xdp->umem_size = (size_t)nb_frames * PICOQUIC_XDP_FRAME_SIZE;
+    xdp_param->xsk_fd = -1;
+
+    if ((xdp->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0) {
+        DBG_PRINTF("Cannot create AF_XDP socket, err=%d", errno);
+        ret = -1;
+    }
+    else if ((xdp->umem = (uint8_t*)mmap(NULL, xdp->umem_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        xdp->umem = NULL;
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((xdp->free_frames = (uint64_t*)malloc(sizeof(uint64_t) * nb_frames)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        struct xdp_umem_reg umem_reg;
+        struct xdp_mmap_offsets off;
+        socklen_t optlen = sizeof(off);
+
+        memset(&umem_reg, 0, sizeof(umem_reg));
+        umem_reg.addr = (uint64_t)(uintptr_t)xdp->umem;
+        umem_reg.len = xdp->umem_size;
+        umem_reg.chunk_size = PICOQUIC_XDP_FRAME_SIZE;
+        umem_reg.headroom = 0;
+
+        if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) != 0 ||
+            setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) != 0 ||
+            setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) != 0 ||
+            setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) != 0 ||
+            setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) != 0 ||
+            getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0) {
+            DBG_PRINTF("Cannot configure the AF_XDP rings, err=%d", errno);
+            ret = -1;
+        }
+        else if (picoquic_xdp_ring_map(xdp->fd, &xdp->rx, &off.rx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+            picoquic_xdp_ring_map(xdp->fd, &xdp->tx, &off.tx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0 ||
+            picoquic_xdp_ring_map(xdp->fd, &xdp->fill, &off.fr, ring_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+            picoquic_xdp_ring_map(xdp->fd, &xdp->comp, &off.cr, ring_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0) {
+            DBG_PRINTF("Cannot map the AF_XDP rings, err=%d", errno);
+            ret = -1;
+        }
+        else {
+            struct sockaddr_xdp sxdp;
+
+            memset(&sxdp, 0, sizeof(sxdp));
+            sxdp.sxdp_family = AF_XDP;
+            sxdp.sxdp_ifindex = (uint32_t)xdp_param->if_index;
+            sxdp.sxdp_queue_id = xdp_param->queue_id;
+            sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | ((xdp_param->zero_copy) ? XDP_ZEROCOPY : 0);
+
+            /* The first half of the frames receives packets, the second half is used for sending */
+            for (uint32_t i = 0; i < ring_size; i++) {
+                picoquic_xdp_fill_frame(xdp, (uint64_t)i * PICOQUIC_XDP_FRAME_SIZE);
+            }
+            for (uint32_t i = ring_size; i < nb_frames; i++) {
+                xdp->free_frames[xdp->nb_free_frames++] = (uint64_t)i * PICOQUIC_XDP_FRAME_SIZE;
+            }
+
+            if (bind(xdp->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) != 0) {
+                DBG_PRINTF("Cannot bind the AF_XDP socket to if %d queue %u, err=%d",
+                    xdp_param->if_index, xdp_param->queue_id, errno);
+                ret = -1;
+            }
+            else {
+                xdp_param->xsk_fd = xdp->fd;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        *io_ctx = xdp;
+    }
+    else {
+        picoquic_xdp_close(xdp);
+    }
+    return ret;
+}
+
+static int picoquic_xdp_get_buffer(void* io_ctx, picoquic_packet_io_t* packet)
+{
+    int ret = 0;
+    picoquic_xdp_ctx_t* xdp = (picoquic_xdp_ctx_t*)io_ctx;
+
+    if (xdp->nb_free_frames == 0) {
+        picoquic_xdp_reclaim(xdp);
+    }
+    if (xdp->nb_free_frames == 0) {
+        ret = -1;
+    }
+    else {
+        uint64_t frame = xdp->free_frames[--xdp->nb_free_frames];
+        packet->bytes = xdp->umem + frame + PICOQUIC_XDP_HEADROOM;
+        packet->buffer_size = PICOQUIC_XDP_FRAME_SIZE - PICOQUIC_XDP_HEADROOM;
+        if (packet->buffer_size > PICOQUIC_MAX_PACKET_SIZE) {
+            packet->buffer_size = PICOQUIC_MAX_PACKET_SIZE;
+        }
+        packet->length = 0;
+        packet->handle = frame | PICOQUIC_XDP_HANDLE_TX;
+    }
+    return ret;
+}
+
+static void picoquic_xdp_release_buffer(void* io_ctx, picoquic_packet_io_t* packet)
+{
+    picoquic_xdp_ctx_t* xdp = (picoquic_xdp_ctx_t*)io_ctx;
+    uint64_t frame = (packet->handle & ~PICOQUIC_XDP_HANDLE_TX) & ~((uint64_t)PICOQUIC_XDP_FRAME_SIZE - 1);
+
+    if (packet->handle & PICOQUIC_XDP_HANDLE_TX) {
+        if (xdp->nb_free_frames < xdp->nb_frames) {
+            xdp->free_frames[xdp->nb_free_frames++] = frame;
+        }
+    }
+    else {
+        picoquic_xdp_fill_frame(xdp, frame);
+    }
+    packet->bytes = NULL;
+}
+
+/* Parse the Ethernet, IP and UDP headers of a received frame.
+ * Returns 0 if this is a UDP packet for the local port. */
+static int picoquic_xdp_parse(picoquic_xdp_ctx_t* xdp, uint8_t* frame, size_t frame_length, picoquic_packet_io_t* packet)
+{
+    int ret = -1;
+    size_t ip_length = 0;
+    size_t udp_offset = 0;
+    uint8_t* ip = frame + PICOQUIC_XDP_ETH_HEADER;
+
+    memset(&packet->addr_peer, 0, sizeof(struct sockaddr_storage));
+    memset(&packet->addr_local, 0, sizeof(struct sockaddr_storage));
+
+    if (frame_length < PICOQUIC_XDP_ETH_HEADER + PICOQUIC_XDP_IPV4_HEADER + PICOQUIC_XDP_UDP_HEADER) {
+        /* Too short */
+    }
+    else if (frame[12] == 0x08 && frame[13] == 0x00) {
+        size_t ihl = (size_t)(ip[0] & 0x0F) * 4;
+
+        ip_length = ((size_t)ip[2] << 8) | ip[3];
+        if ((ip[0] >> 4) == 4 && ihl >= PICOQUIC_XDP_IPV4_HEADER && ip[9] == 17 &&
+            (((ip[6] << 8) | ip[7]) & 0x3FFF) == 0 && ip_length >= ihl + PICOQUIC_XDP_UDP_HEADER &&
+            PICOQUIC_XDP_ETH_HEADER + ip_length <= frame_length) {
+            struct sockaddr_in* peer = (struct sockaddr_in*)&packet->addr_peer;
+            struct sockaddr_in* local = (struct sockaddr_in*)&packet->addr_local;
+
+            peer->sin_family = AF_INET;
+            memcpy(&peer->sin_addr, ip + 12, 4);
+            local->sin_family = AF_INET;
+            memcpy(&local->sin_addr, ip + 16, 4);
+            packet->ecn = ip[1] & 0x03;
+            udp_offset = ihl;
+            ret = 0;
+        }
+    }
+    else if (frame[12] == 0x86 && frame[13] == 0xDD &&
+        frame_length >= PICOQUIC_XDP_ETH_HEADER + PICOQUIC_XDP_IPV6_HEADER + PICOQUIC_XDP_UDP_HEADER) {
+        ip_length = PICOQUIC_XDP_IPV6_HEADER + (((size_t)ip[4] << 8) | ip[5]);
+        if ((ip[0] >> 4) == 6 && ip[6] == 17 && PICOQUIC_XDP_ETH_HEADER + ip_length <= frame_length) {
+            struct sockaddr_in6* peer = (struct sockaddr_in6*)&packet->addr_peer;
+            struct sockaddr_in6* local = (struct sockaddr_in6*)&packet->addr_local;
+
+            peer->sin6_family = AF_INET6;
+            memcpy(&peer->sin6_addr, ip + 8, 16);
+            local->sin6_family = AF_INET6;
+            memcpy(&local->sin6_addr, ip + 24, 16);
+            packet->ecn = (ip[1] >> 4) & 0x03;
+            udp_offset = PICOQUIC_XDP_IPV6_HEADER;
+            ret = 0;
+        }
+    }
+
+    if (ret == 0) {
+        uint8_t* udp = ip + udp_offset;
+        size_t udp_length = ((size_t)udp[4] << 8) | udp[5];
+        uint16_t n_dport;
+        uint16_t n_sport;
+
+        memcpy(&n_sport, udp, 2);
+        memcpy(&n_dport, udp + 2, 2);
+        if (n_dport != xdp->n_port || udp_length < PICOQUIC_XDP_UDP_HEADER || udp_offset + udp_length > ip_length) {
+            ret = -1;
+        }
+        else {
+            if (packet->addr_peer.ss_family == AF_INET) {
+                ((struct sockaddr_in*)&packet->addr_peer)->sin_port = n_sport;
+                ((struct sockaddr_in*)&packet->addr_local)->sin_port = n_dport;
+            }
+            else {
+                ((struct sockaddr_in6*)&packet->addr_peer)->sin6_port = n_sport;
+                ((struct sockaddr_in6*)&packet->addr_local)->sin6_port = n_dport;
+            }
+            packet->bytes = udp + PICOQUIC_XDP_UDP_HEADER;
+            packet->length = udp_length - PICOQUIC_XDP_UDP_HEADER;
+            packet->if_index = xdp->xdp_param->if_index;
+            memcpy(xdp->last_peer_mac, frame + 6, 6);
+            xdp->has_peer_mac = 1;
+        }
+    }
+    return ret;
+}
+
+static int picoquic_xdp_rx_burst(void* io_ctx, picoquic_packet_io_t* packets, int nb_max)
+{
+    picoquic_xdp_ctx_t* xdp = (picoquic_xdp_ctx_t*)io_ctx;
+    uint32_t nb = picoquic_xdp_ring_available(&xdp->rx);
+    uint32_t cons = *xdp->rx.consumer;
+    uint32_t nb_consumed = 0;
+    int nb_received = 0;
+
+    while (nb_consumed < nb && nb_received < nb_max) {
+        struct xdp_desc* desc = &((struct xdp_desc*)xdp->rx.desc)[(cons + nb_consumed) & xdp->rx.mask];
+        picoquic_packet_io_t* packet = &packets[nb_received];
+
+        packet->handle = desc->addr;
+        packet->send_msg_size = 0;
+        packet->receive_time = 0;
+        nb_consumed++;
+        if (picoquic_xdp_parse(xdp, xdp->umem + desc->addr, desc->len, packet) == 0) {
+            nb_received++;
+        }
+        else {
+            picoquic_xdp_release_buffer(io_ctx, packet);
+        }
+    }
+    if (nb_consumed > 0) {
+        __atomic_store_n(xdp->rx.consumer, cons + nb_consumed, __ATOMIC_RELEASE);
+    }
+    return nb_received;
+}
+
+static uint32_t picoquic_xdp_checksum_add(uint32_t sum, const uint8_t* bytes, size_t length)
+{
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        sum += ((uint32_t)bytes[i] << 8) | bytes[i + 1];
+    }
+    if (length & 1) {
+        sum += (uint32_t)bytes[length - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t picoquic_xdp_checksum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+/* Write the headers in the headroom of the frame, and return their length, or 0
+ * if the packet cannot be sent. */
+static size_t picoquic_xdp_build_headers(picoquic_xdp_ctx_t* xdp, picoquic_packet_io_t* packet, int* sock_err)
+{
+    picoquic_xdp_param_t* xdp_param = xdp->xdp_param;
+    const uint8_t* dst_mac = xdp_param->next_hop_mac;
+    static const uint8_t zero_mac[6] = { 0 };
+    size_t header_length = 0;
+    uint8_t* udp = packet->bytes - PICOQUIC_XDP_UDP_HEADER;
+    size_t udp_length = packet->length + PICOQUIC_XDP_UDP_HEADER;
+    uint32_t sum = 17 + (uint32_t)udp_length;
+    uint16_t checksum;
+
+    if (memcmp(dst_mac, zero_mac, 6) == 0) {
+        dst_mac = (xdp->has_peer_mac) ? xdp->last_peer_mac : NULL;
+    }
+
+    if (dst_mac == NULL) {
+        *sock_err = EHOSTUNREACH;
+    }
+    else if (packet->addr_peer.ss_family == AF_INET && xdp_param->local_addr_v4.sin_family == AF_INET) {
+        struct sockaddr_in* peer = (struct sockaddr_in*)&packet->addr_peer;
+        struct sockaddr_in* local = (struct sockaddr_in*)&packet->addr_local;
+        const struct in_addr* src = (local->sin_family == AF_INET && local->sin_addr.s_addr != 0) ?
+            &local->sin_addr : &xdp_param->local_addr_v4.sin_addr;
+        uint8_t* ip = udp - PICOQUIC_XDP_IPV4_HEADER;
+        size_t ip_length = PICOQUIC_XDP_IPV4_HEADER + udp_length;
+
+        memset(ip, 0, PICOQUIC_XDP_IPV4_HEADER);
+        ip[0] = 0x45;
+        ip[1] = PICOQUIC_ECN_ECT_1;
+        ip[2] = (uint8_t)(ip_length >> 8);
+        ip[3] = (uint8_t)ip_length;
+        ip[6] = 0x40; /* Don't fragment */
+        ip[8] = 64;
+        ip[9] = 17;
+        memcpy(ip + 12, src, 4);
+        memcpy(ip + 16, &peer->sin_addr, 4);
+        checksum = picoquic_xdp_checksum_fold(picoquic_xdp_checksum_add(0, ip, PICOQUIC_XDP_IPV4_HEADER));
+        ip[10] = (uint8_t)(checksum >> 8);
+        ip[11] = (uint8_t)checksum;
+        sum = picoquic_xdp_checksum_add(sum, ip + 12, 8);
+        memcpy(udp + 2, &peer->sin_port, 2);
+        header_length = PICOQUIC_XDP_ETH_HEADER + PICOQUIC_XDP_IPV4_HEADER + PICOQUIC_XDP_UDP_HEADER;
+    }
+    else if (packet->addr_peer.ss_family == AF_INET6 && xdp_param->local_addr_v6.sin6_family == AF_INET6) {
+        struct sockaddr_in6* peer = (struct sockaddr_in6*)&packet->addr_peer;
+        struct sockaddr_in6* local = (struct sockaddr_in6*)&packet->addr_local;
+        const struct in6_addr* src = (local->sin6_family == AF_INET6 && !IN6_IS_ADDR_UNSPECIFIED(&local->sin6_addr)) ?
+            &local->sin6_addr : &xdp_param->local_addr_v6.sin6_addr;
+        uint8_t* ip = udp - PICOQUIC_XDP_IPV6_HEADER;
+
+        memset(ip, 0, PICOQUIC_XDP_IPV6_HEADER);
+        ip[0] = 0x60;
+        ip[1] = PICOQUIC_ECN_ECT_1 << 4;
+        ip[4] = (uint8_t)(udp_length >> 8);
+        ip[5] = (uint8_t)udp_length;
+        ip[6] = 17;
+        ip[7] = 64;
+        memcpy(ip + 8, src, 16);
+        memcpy(ip + 24, &peer->sin6_addr, 16);
+        sum = picoquic_xdp_checksum_add(sum, ip + 8, 32);
+        memcpy(udp + 2, &peer->sin6_port, 2);
+        header_length = PICOQUIC_XDP_ETH_HEADER + PICOQUIC_XDP_IPV6_HEADER + PICOQUIC_XDP_UDP_HEADER;
+    }
+    else {
+        *sock_err = EAFNOSUPPORT;
+    }
+
+    if (header_length > 0) {
+        uint8_t* eth = packet->bytes - header_length;
+
+        memcpy(udp, &xdp->n_port, 2);
+        udp[4] = (uint8_t)(udp_length >> 8);
+        udp[5] = (uint8_t)udp_length;
+        udp[6] = 0;
+        udp[7] = 0;
+        sum = picoquic_xdp_checksum_add(sum, udp, udp_length);
+        checksum = picoquic_xdp_checksum_fold(sum);
+        if (checksum == 0) {
+            checksum = 0xFFFF;
+        }
+        udp[6] = (uint8_t)(checksum >> 8);
+        udp[7] = (uint8_t)checksum;
+
+        memcpy(eth, dst_mac, 6);
+        memcpy(eth + 6, xdp_param->local_mac, 6);
+        eth[12] = (packet->addr_peer.ss_family == AF_INET) ? 0x08 : 0x86;
+        eth[13] = (packet->addr_peer.ss_family == AF_INET) ? 0x00 : 0xDD;
+    }
+    return header_length;
+}
+
+static int picoquic_xdp_tx_burst(void* io_ctx, picoquic_packet_io_t* packets, int nb_packets, int* sock_err)
+{
+    picoquic_xdp_ctx_t* xdp = (picoquic_xdp_ctx_t*)io_ctx;
+    uint32_t prod = *xdp->tx.producer;
+    uint32_t nb_free;
+    int nb_sent = 0;
+
+    *sock_err = 0;
+    picoquic_xdp_reclaim(xdp);
+    nb_free = picoquic_xdp_ring_free(&xdp->tx);
+
+    while (nb_sent < nb_packets) {
+        picoquic_packet_io_t* packet = &packets[nb_sent];
+        struct xdp_desc* desc;
+        size_t header_length;
+
+        if ((uint32_t)nb_sent >= nb_free) {
+            *sock_err = EAGAIN;
+            break;
+        }
+        if ((header_length = picoquic_xdp_build_headers(xdp, packet, sock_err)) == 0) {
+            break;
+        }
+        desc = &((struct xdp_desc*)xdp->tx.desc)[(prod + (uint32_t)nb_sent) & xdp->tx.mask];
+        desc->addr = (uint64_t)(packet->bytes - header_length - xdp->umem);
+        desc->len = (uint32_t)(header_length + packet->length);
+        desc->options = 0;
+        /* The frame belongs to the kernel until the completion */
+        packet->bytes = NULL;
+        nb_sent++;
+    }
+
+    if (nb_sent > 0) {
+        __atomic_store_n(xdp->tx.producer, prod + (uint32_t)nb_sent, __ATOMIC_RELEASE);
+        if (__atomic_load_n(xdp->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+            if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+                errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN) {
+                DBG_PRINTF("AF_XDP transmit kick fails, err=%d", errno);
+            }
+        }
+    }
+    return nb_sent;
+}
+
+static int picoquic_xdp_wait(void* io_ctx, int64_t delta_t, int* is_wake_up)
+{
+    picoquic_xdp_ctx_t* xdp = (picoquic_xdp_ctx_t*)io_ctx;
+    struct pollfd fds[2];
+    nfds_t nfds = 1;
+    struct timespec ts;
+    int ret = 0;
+    int ret_poll;
+
+    *is_wake_up = 0;
+    if (picoquic_xdp_ring_available(&xdp->rx) > 0) {
+        return 1;
+    }
+
+    fds[0].fd = xdp->fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if (xdp->wake_up_fd >= 0) {
+        fds[1].fd = xdp->wake_up_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        nfds = 2;
+    }
+    if (delta_t <= 0) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = 0;
+    }
+    else {
+        if (delta_t > 10000000) {
+            delta_t = 10000000;
+        }
+        ts.tv_sec = (time_t)(delta_t / 1000000);
+        ts.tv_nsec = (long)((delta_t % 1000000) * 1000);
+    }
+
+    /* The poll also wakes up the driver if the fill ring needs it */
+    if ((ret_poll = ppoll(fds, nfds, &ts, NULL)) < 0) {
+        if (errno != EINTR) {
+            DBG_PRINTF("Error: ppoll returns %d, err=%d\n", ret_poll, errno);
+            ret = -1;
+        }
+    }
+    else if (ret_poll > 0) {
+        if (nfds > 1 && (fds[1].revents & POLLIN) != 0) {
+            *is_wake_up = 1;
+        }
+        ret = ((fds[0].revents & POLLIN) != 0) ? 1 : 0;
+    }
+    return ret;
+}
+
+const picoquic_packet_io_provider_t picoquic_xdp_io_provider = {
+    "af_xdp",
+    picoquic_xdp_open,
+    picoquic_xdp_close,
+    picoquic_xdp_rx_burst,
+    picoquic_xdp_tx_burst,
+    picoquic_xdp_get_buffer,
+    picoquic_xdp_release_buffer,
+    picoquic_xdp_wait,
+    NULL,
+    0
+};
+#endif
@@ -0,0 +1,584 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Session ticket key ring.
+*
+* By default, session tickets are protected with a single key, set when the
+* QUIC context is created. Changing that key invalidates all the tickets
+* issued so far. The key ring holds up to three keys, each identified by
+* a one byte key ID:
+*
+* - the "next" key, installed ahead of rotation so that all the servers of
+*   a farm can decrypt the tickets issued with it before any of them starts
+*   using it,
+* - the "current" key, used to encrypt new tickets,
+* - the "previous" key, kept so that tickets issued before the last
+*   rotation remain valid.
+*
+* When the ring has a current key, tickets start with the key ID, followed
+* by the 64 bit ticket sequence number and the encrypted ticket. The server
+* selects the decryption key from the ID, and refuses tickets with an unknown
+* ID without attempting decryption.
+*
+* The keys are kept in a small table, allocated in memory or mapped from a
+* file shared by several processes. The table is updated with a sequence
+* lock: writers make the generation number odd while they modify the keys,
+* readers copy the keys and retry later if the generation changed meanwhile.
+* Each QUIC context keeps its own AEAD contexts, prebuilt when it sees a new
+* generation, and reused across rotations: rotating only moves the contexts
+* between the current and previous slots. The keys can thus be installed
+* and rotated from a control thread, or from another process, while the
+* server runs.
+*
+* The key ring only protects session tickets. Retry and new tokens are
+* short lived, and remain protected by the key of the QUIC context.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "tls_api.h"
+
+#define PICOQUIC_TICKET_KEYS_MAGIC 0x5051544b
+#define PICOQUIC_TICKET_KEYS_INIT 0x50515400
+#define PICOQUIC_TICKET_KEYS_FORMAT 1
+#define PICOQUIC_TICKET_KEYS_WAIT 100000
+
+typedef enum {
+    picoquic_ticket_key_previous = 0,
+    picoquic_ticket_key_current = 1,
+    picoquic_ticket_key_next = 2,
+    picoquic_ticket_key_nb_slots = 3
+} picoquic_ticket_key_slot_enum;
+
+typedef struct st_picoquic_ticket_key_entry_t {
+    uint32_t is_set;
+    uint32_t key_id;
+    uint8_t key[PICOQUIC_TICKET_KEY_SIZE];
+} picoquic_ticket_key_entry_t;
+
+typedef struct st_picoquic_ticket_key_table_t {
+    volatile uint32_t magic;
+    uint32_t format;
+    volatile uint32_t generation; /* odd while the entries are updated */
+    uint32_t reserved;
+    picoquic_ticket_key_entry_t entry[picoquic_ticket_key_nb_slots];
+} picoquic_ticket_key_table_t;
+
+typedef struct st_picoquic_ticket_key_slot_t {
+    int is_set;
+    uint8_t key_id;
+    uint8_t key[PICOQUIC_TICKET_KEY_SIZE];
+    void* aead_encrypt;
+    void* aead_decrypt;
+} picoquic_ticket_key_slot_t;
+
+struct st_picoquic_ticket_key_ring_t {
+    picoquic_ticket_key_table_t* table;
+    int is_shared;
+#ifdef _WINDOWS
+    HANDLE file_handle;
+    HANDLE map_handle;
+#else
+    int fd;
+#endif
+    uint32_t generation; /* generation of the table loaded in the slots */
+    picoquic_ticket_key_slot_t slot[picoquic_ticket_key_nb_slots];
+};
+
+#ifdef _WINDOWS
+#define PICOQUIC_TICKET_KEYS_CAS32(p, e, v) (InterlockedCompareExchange((LONG volatile*)(p), (LONG)(v), (LONG)(e)) == (LONG)(e))
+#define PICOQUIC_TICKET_KEYS_FENCE() MemoryBarrier()
+#define PICOQUIC_TICKET_KEYS_YIELD() Sleep(0)
+#else
+static int picoquic_ticket_keys_cas32(volatile uint32_t* p, uint32_t expected, uint32_t v)
+{
+    return __atomic_compare_exchange_n(p, &expected, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+#define PICOQUIC_TICKET_KEYS_CAS32(p, e, v) picoquic_ticket_keys_cas32((p), (e), (v))
+#define PICOQUIC_TICKET_KEYS_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define PICOQUIC_TICKET_KEYS_YIELD() (void)sched_yield()
+#endif
+
+static void picoquic_ticket_key_slot_clear(picoquic_ticket_key_slot_t* slot)
+{
+    if (slot->aead_encrypt != NULL) {
+        picoquic_aead_free(slot->aead_encrypt);
+    }
+    if (slot->aead_decrypt != NULL) {
+        picoquic_aead_free(slot->aead_decrypt);
+    }
+    memset(slot, 0, sizeof(picoquic_ticket_key_slot_t));
+}
+
+static void picoquic_ticket_key_ring_delete(picoquic_ticket_key_ring_t* ring)
+{
+    for (int i = 0; i < picoquic_ticket_key_nb_slots; i++) {
+        picoquic_ticket_key_slot_clear(&ring->slot[i]);
+    }
+    if (ring->is_shared) {
+#ifdef _WINDOWS
+        if (ring->table != NULL) {
+            (void)UnmapViewOfFile(ring->table);
+        }
+        if (ring->map_handle != NULL) {
+            (void)CloseHandle(ring->map_handle);
+        }
+        if (ring->file_handle != INVALID_HANDLE_VALUE) {
+            (void)CloseHandle(ring->file_handle);
+        }
+#else
+        if (ring->table != NULL) {
+            (void)munmap(ring->table, sizeof(picoquic_ticket_key_table_t));
+        }
+        if (ring->fd >= 0) {
+            (void)close(ring->fd);
+        }
+#endif
+    }
+    else if (ring->table != NULL) {
+        memset(ring->table, 0, sizeof(picoquic_ticket_key_table_t));
+        free(ring->table);
+    }
+    free(ring);
+}
+
+static picoquic_ticket_key_ring_t* picoquic_ticket_key_ring_alloc()
+{
+    picoquic_ticket_key_ring_t* ring = (picoquic_ticket_key_ring_t*)malloc(sizeof(picoquic_ticket_key_ring_t));
+
+    if (ring != NULL) {
+        memset(ring, 0, sizeof(picoquic_ticket_key_ring_t));
+        /* An odd generation is never stable, so the first lookup loads the table */
+        ring->generation = 1;
+#ifdef _WINDOWS
+        ring->file_handle = INVALID_HANDLE_VALUE;
+#else
+        ring->fd = -1;
+#endif
+    }
+
+    return ring;
+}
+
+/* Open or create the file, and map it, as done for the shared ticket store */
+static int picoquic_ticket_key_ring_map(picoquic_ticket_key_ring_t* ring, char const* file_name)
+{
+    int ret = 0;
+    const size_t map_size = sizeof(picoquic_ticket_key_table_t);
+
+    ring->is_shared = 1;
+#ifdef _WINDOWS
+    ring->file_handle = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (ring->file_handle == INVALID_HANDLE_VALUE) {
+        ret = -1;
+    }
+    else {
+        LARGE_INTEGER file_size;
+
+        if (!GetFileSizeEx(ring->file_handle, &file_size) ||
+            ((uint64_t)file_size.QuadPart != 0 && (uint64_t)file_size.QuadPart != (uint64_t)map_size)) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else {
+            ring->map_handle = CreateFileMappingA(ring->file_handle, NULL, PAGE_READWRITE,
+                0, (DWORD)map_size, NULL);
+            if (ring->map_handle == NULL ||
+                (ring->table = (picoquic_ticket_key_table_t*)MapViewOfFile(ring->map_handle, FILE_MAP_ALL_ACCESS, 0, 0, map_size)) == NULL) {
+                ret = -1;
+            }
+        }
+    }
+#else
+    ring->fd = open(file_name, O_RDWR | O_CREAT, 0600);
+    if (ring->fd < 0) {
+        ret = -1;
+    }
+    else {
+        struct stat st;
+
+        if (fstat(ring->fd, &st) != 0 ||
+            (st.st_size != 0 && (uint64_t)st.st_size != (uint64_t)map_size)) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else if (st.st_size == 0 && ftruncate(ring->fd, (off_t)map_size) != 0) {
+            ret = -1;
+        }
+        else {
+            ring->table = (picoquic_ticket_key_table_t*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+            if (ring->table == (picoquic_ticket_key_table_t*)MAP_FAILED) {
+                ring->table = NULL;
+                ret = -1;
+            }
+        }
+    }
+#endif
+    return ret;
+}
+
+/* The first process to map the file sets the header, the others verify
+ * that the format matches. */
+static int picoquic_ticket_key_ring_init_header(picoquic_ticket_key_table_t* table)
+{
+    int ret = 0;
+
+    if (PICOQUIC_TICKET_KEYS_CAS32(&table->magic, 0, PICOQUIC_TICKET_KEYS_INIT)) {
+        table->format = PICOQUIC_TICKET_KEYS_FORMAT;
+        PICOQUIC_TELEMETRY_STORE32(&table->magic, PICOQUIC_TICKET_KEYS_MAGIC);
+    }
+    else {
+        int nb_wait = 0;
+
+        while (PICOQUIC_TELEMETRY_LOAD32(&table->magic) == PICOQUIC_TICKET_KEYS_INIT &&
+            nb_wait < PICOQUIC_TICKET_KEYS_WAIT) {
+            PICOQUIC_TICKET_KEYS_YIELD();
+            nb_wait++;
+        }
+        if (PICOQUIC_TELEMETRY_LOAD32(&table->magic) != PICOQUIC_TICKET_KEYS_MAGIC ||
+            table->format != PICOQUIC_TICKET_KEYS_FORMAT) {
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+    }
+
+    return ret;
+}
+
+/* Create the in memory key table if the context does not have one yet */
+static int picoquic_ticket_key_ring_get(picoquic_quic_t* quic, picoquic_ticket_key_table_t** table)
+{
+    int ret = 0;
+
+    if (quic->ticket_keys == NULL) {
+        picoquic_ticket_key_ring_t* ring = picoquic_ticket_key_ring_alloc();
+
+        if (ring == NULL ||
+            (ring->table = (picoquic_ticket_key_table_t*)malloc(sizeof(picoquic_ticket_key_table_t))) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+            if (ring != NULL) {
+                picoquic_ticket_key_ring_delete(ring);
+            }
+        }
+        else {
+            memset(ring->table, 0, sizeof(picoquic_ticket_key_table_t));
+            ring->table->magic = PICOQUIC_TICKET_KEYS_MAGIC;
+            ring->table->format = PICOQUIC_TICKET_KEYS_FORMAT;
+            quic->ticket_keys = ring;
+        }
+    }
+
+    *table = (ret == 0) ? quic->ticket_keys->table : NULL;
+
+    return ret;
+}
+
+int picoquic_attach_shared_ticket_keys(picoquic_quic_t* quic, char const* file_name)
+{
+    int ret = 0;
+
+    picoquic_ticket_key_ring_free(quic);
+
+    if (file_name == NULL) {
+        ret = PICOQUIC_ERROR_INVALID_FILE;
+    }
+    else {
+        picoquic_ticket_key_ring_t* ring = picoquic_ticket_key_ring_alloc();
+
+        if (ring == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else if ((ret = picoquic_ticket_key_ring_map(ring, file_name)) != 0 ||
+            (ret = picoquic_ticket_key_ring_init_header(ring->table)) != 0) {
+            DBG_PRINTF("Cannot attach ticket key table <%s>, ret = 0x%x", file_name, ret);
+            picoquic_ticket_key_ring_delete(ring);
+            ret = PICOQUIC_ERROR_INVALID_FILE;
+        }
+        else {
+            quic->ticket_keys = ring;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_ticket_key_ring_free(picoquic_quic_t* quic)
+{
+    if (quic->ticket_keys != NULL) {
+        picoquic_ticket_key_ring_delete(quic->ticket_keys);
+        quic->ticket_keys = NULL;
+    }
+}
+
+/* Writers make the generation odd while they update the entries. A writer
+ * that stays stuck, e.g. because its process died, blocks further updates
+ * but not the use of the keys already loaded. */
+static int picoquic_ticket_key_table_lock(picoquic_ticket_key_table_t* table, uint32_t* generation)
+{
+    int ret = PICOQUIC_ERROR_UNEXPECTED_STATE;
+
+    for (int nb_wait = 0; nb_wait < PICOQUIC_TICKET_KEYS_WAIT; nb_wait++) {
+        uint32_t g = PICOQUIC_TELEMETRY_LOAD32(&table->generation);
+
+        if ((g & 1) == 0 && PICOQUIC_TICKET_KEYS_CAS32(&table->generation, g, g + 1)) {
+            *generation = g + 1;
+            ret = 0;
+            break;
+        }
+        PICOQUIC_TICKET_KEYS_YIELD();
+    }
+
+    return ret;
+}
+
+static void picoquic_ticket_key_table_unlock(picoquic_ticket_key_table_t* table, uint32_t generation)
+{
+    PICOQUIC_TELEMETRY_STORE32(&table->generation, generation + 1);
+}
+
+static int picoquic_ticket_key_entry_is(const picoquic_ticket_key_entry_t* entry, uint8_t key_id, const uint8_t* key)
+{
+    return entry->is_set && entry->key_id == key_id && memcmp(entry->key, key, PICOQUIC_TICKET_KEY_SIZE) == 0;
+}
+
+/* Install the key that will become current at the next rotation. Installing
+ * the same key again has no effect, so that all the processes of a server
+ * farm sharing a key table may do it. A key ID that is already used by the
+ * current or previous key cannot be reused for a different key.
+ */
+int picoquic_set_next_ticket_key(picoquic_quic_t* quic, uint8_t key_id, const uint8_t* key, size_t key_length)
+{
+    int ret = 0;
+    picoquic_ticket_key_table_t* table = NULL;
+    uint8_t padded_key[PICOQUIC_TICKET_KEY_SIZE];
+    uint32_t generation = 0;
+
+    if (key == NULL || key_length == 0) {
+        ret = -1;
+    }
+    else if ((ret = picoquic_ticket_key_ring_get(quic, &table)) == 0 &&
+        (ret = picoquic_ticket_key_table_lock(table, &generation)) == 0) {
+        picoquic_ticket_key_entry_t* next = &table->entry[picoquic_ticket_key_next];
+
+        memset(padded_key, 0, sizeof(padded_key));
+        memcpy(padded_key, key, (key_length > sizeof(padded_key)) ? sizeof(padded_key) : key_length);
+
+        for (int i = picoquic_ticket_key_previous; i <= picoquic_ticket_key_current; i++) {
+            if (table->entry[i].is_set && table->entry[i].key_id == key_id &&
+                !picoquic_ticket_key_entry_is(&table->entry[i], key_id, padded_key)) {
+                ret = PICOQUIC_ERROR_UNEXPECTED_STATE;
+            }
+        }
+
+        if (ret == 0 && !picoquic_ticket_key_entry_is(next, key_id, padded_key) &&
+            !picoquic_ticket_key_entry_is(&table->entry[picoquic_ticket_key_current], key_id, padded_key) &&
+            !picoquic_ticket_key_entry_is(&table->entry[picoquic_ticket_key_previous], key_id, padded_key)) {
+            next->is_set = 1;
+            next->key_id = key_id;
+            memcpy(next->key, padded_key, sizeof(padded_key));
+        }
+        picoquic_ticket_key_table_unlock(table, generation);
+        memset(padded_key, 0, sizeof(padded_key));
+    }
+
+    return ret;
+}
+
+/* Promote the next key to current, and the current key to previous. The
+ * rotation is designated by the ID of the new current key, so that it is
+ * only applied once when several processes share the table.
+ */
+int picoquic_rotate_ticket_keys(picoquic_quic_t* quic, uint8_t key_id)
+{
+    int ret = 0;
+    picoquic_ticket_key_table_t* table = NULL;
+    uint32_t generation = 0;
+
+    if ((ret = picoquic_ticket_key_ring_get(quic, &table)) == 0 &&
+        (ret = picoquic_ticket_key_table_lock(table, &generation)) == 0) {
+        picoquic_ticket_key_entry_t* entry = table->entry;
+
+        if (entry[picoquic_ticket_key_current].is_set && entry[picoquic_ticket_key_current].key_id == key_id) {
+            /* Already rotated */
+        }
+        else if (entry[picoquic_ticket_key_next].is_set && entry[picoquic_ticket_key_next].key_id == key_id) {
+            entry[picoquic_ticket_key_previous] = entry[picoquic_ticket_key_current];
+            entry[picoquic_ticket_key_current] = entry[picoquic_ticket_key_next];
+            memset(&entry[picoquic_ticket_key_next], 0, sizeof(picoquic_ticket_key_entry_t));
+        }
+        else {
+            ret = PICOQUIC_ERROR_UNEXPECTED_STATE;
+        }
+        picoquic_ticket_key_table_unlock(table, generation);
+    }
+
+    return ret;
+}
+
+/* Copy the entries of the table, retrying if a writer modified them meanwhile.
+ * Returns the generation of the copy, or an odd number if no stable copy
+ * could be obtained. */
+static uint32_t picoquic_ticket_key_table_read(picoquic_ticket_key_table_t* table,
+    picoquic_ticket_key_entry_t entry[picoquic_ticket_key_nb_slots], int max_attempts)
+{
+    uint32_t generation = 1;
+
+    for (int i = 0; i < max_attempts; i++) {
+        uint32_t g = PICOQUIC_TELEMETRY_LOAD32(&table->generation);
+
+        if ((g & 1) == 0) {
+            memcpy(entry, table->entry, picoquic_ticket_key_nb_slots * sizeof(picoquic_ticket_key_entry_t));
+            PICOQUIC_TICKET_KEYS_FENCE();
+            if (PICOQUIC_TELEMETRY_LOAD32(&table->generation) == g) {
+                generation = g;
+                break;
+            }
+        }
+        PICOQUIC_TICKET_KEYS_YIELD();
+    }
+
+    return generation;
+}
+
+int picoquic_get_current_ticket_key_id(picoquic_quic_t* quic, uint8_t* key_id)
+{
+    int ret = -1;
+
+    if (quic->ticket_keys != NULL) {
+        picoquic_ticket_key_entry_t entry[picoquic_ticket_key_nb_slots];
+
+        if ((picoquic_ticket_key_table_read(quic->ticket_keys->table, entry, PICOQUIC_TICKET_KEYS_WAIT) & 1) == 0 &&
+            entry[picoquic_ticket_key_current].is_set) {
+            *key_id = (uint8_t)entry[picoquic_ticket_key_current].key_id;
+            ret = 0;
+        }
+        memset(entry, 0, sizeof(entry));
+    }
+
+    return ret;
+}
+
+/* Load a new generation of the table in the slots. AEAD contexts of keys
+ * that were already loaded are moved to their new slot, the others are
+ * created. */
+static void picoquic_ticket_key_ring_load(picoquic_ticket_key_ring_t* ring,
+    const picoquic_ticket_key_entry_t entry[picoquic_ticket_key_nb_slots])
+{
+    picoquic_ticket_key_slot_t new_slot[picoquic_ticket_key_nb_slots];
+
+    memset(new_slot, 0, sizeof(new_slot));
+
+    for (int i = 0; i < picoquic_ticket_key_nb_slots; i++) {
+        if (entry[i].is_set) {
+            for (int j = 0; j < picoquic_ticket_key_nb_slots; j++) {
+                if (ring->slot[j].is_set && ring->slot[j].key_id == (uint8_t)entry[i].key_id &&
+                    memcmp(ring->slot[j].key, entry[i].key, PICOQUIC_TICKET_KEY_SIZE) == 0) {
+                    new_slot[i] = ring->slot[j];
+                    memset(&ring->slot[j], 0, sizeof(picoquic_ticket_key_slot_t));
+                    break;
+                }
+            }
+            if (!new_slot[i].is_set) {
+                if (picoquic_create_ticket_key_contexts(entry[i].key, PICOQUIC_TICKET_KEY_SIZE,
+                    &new_slot[i].aead_encrypt, &new_slot[i].aead_decrypt) == 0) {
+                    new_slot[i].is_set = 1;
+                    new_slot[i].key_id = (uint8_t)entry[i].key_id;
+                    memcpy(new_slot[i].key, entry[i].key, PICOQUIC_TICKET_KEY_SIZE);
+                }
+                else {
+                    DBG_PRINTF("Cannot create the contexts of ticket key %u", entry[i].key_id);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < picoquic_ticket_key_nb_slots; i++) {
+        picoquic_ticket_key_slot_clear(&ring->slot[i]);
+        ring->slot[i] = new_slot[i];
+    }
+    memset(new_slot, 0, sizeof(new_slot));
+}
+
+/* Called before processing a ticket. Only one attempt is made at reading
+ * the table: if a writer is active, the keys of the previous generation
+ * are used. */
+int picoquic_ticket_key_ring_is_active(picoquic_quic_t* quic)
+{
+    int is_active = 0;
+    picoquic_ticket_key_ring_t* ring = quic->ticket_keys;
+
+    if (ring != NULL) {
+        uint32_t generation = PICOQUIC_TELEMETRY_LOAD32(&ring->table->generation);
+
+        if (generation != ring->generation) {
+            picoquic_ticket_key_entry_t entry[picoquic_ticket_key_nb_slots];
+
+            generation = picoquic_ticket_key_table_read(ring->table, entry, 1);
+            if ((generation & 1) == 0) {
+                picoquic_ticket_key_ring_load(ring, entry);
+                ring->generation = generation;
+            }
+            memset(entry, 0, sizeof(entry));
+        }
+        is_active = ring->slot[picoquic_ticket_key_current].is_set;
+    }
+
+    return is_active;
+}
+
+void* picoquic_ticket_key_ring_encrypt_ctx(picoquic_quic_t* quic, uint8_t* key_id)
+{
+    void* aead_encrypt = NULL;
+    picoquic_ticket_key_ring_t* ring = quic->ticket_keys;
+
+    if (ring != NULL && ring->slot[picoquic_ticket_key_current].is_set) {
+        *key_id = ring->slot[picoquic_ticket_key_current].key_id;
+        aead_encrypt = ring->slot[picoquic_ticket_key_current].aead_encrypt;
+    }
+
+    return aead_encrypt;
+}
+
+void* picoquic_ticket_key_ring_decrypt_ctx(picoquic_quic_t* quic, uint8_t key_id)
+{
+    void* aead_decrypt = NULL;
+    picoquic_ticket_key_ring_t* ring = quic->ticket_keys;
+
+    if (ring != NULL) {
+        for (int i = 0; i < picoquic_ticket_key_nb_slots; i++) {
+            if (ring->slot[i].is_set && ring->slot[i].key_id == key_id) {
+                aead_decrypt = ring->slot[i].aead_decrypt;
+                break;
+            }
+        }
+    }
+
+    return aead_decrypt;
+}
@@ -256,6 +256,217 @@ int picoquic_deserialize_ticket(picoquic_stored_ticket_t ** ticket, uint8_t * by
     return ret;
 }
 
+/* Hash index of the stored tickets.
+ * The bins chain the tickets sharing the same (SNI, ALPN) hash, in the same
+ * relative order as the main list, so that lookups return the same ticket
+ * as a scan of the list would. If the bins cannot be allocated, lookups fall
+ * back to scanning the list.
+ */
+static uint64_t picoquic_stored_ticket_hash(picoquic_quic_t* quic,
+    char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length)
+{
+    uint64_t h = picohash_siphash((const uint8_t*)sni, sni_length, quic->hash_seed);
+    h ^= picohash_siphash((const uint8_t*)alpn, alpn_length, quic->hash_seed) * 0x9E3779B97F4A7C15ull;
+
+    return h;
+}
+
+static void picoquic_stored_ticket_bin_insert(picoquic_stored_ticket_index_t* index, picoquic_stored_ticket_t* stored)
+{
+    if (index->bins != NULL) {
+        picoquic_stored_ticket_t** bin = &index->bins[stored->index_hash & (index->nb_bins - 1)];
+        stored->next_in_bin = *bin;
+        *bin = stored;
+    }
+}
+
+static void picoquic_stored_ticket_bin_remove(picoquic_stored_ticket_index_t* index, picoquic_stored_ticket_t* stored)
+{
+    if (index->bins != NULL) {
+        picoquic_stored_ticket_t** pprevious = &index->bins[stored->index_hash & (index->nb_bins - 1)];
+
+        while (*pprevious != NULL) {
+            if (*pprevious == stored) {
+                *pprevious = stored->next_in_bin;
+                break;
+            }
+            pprevious = &(*pprevious)->next_in_bin;
+        }
+    }
+    stored->next_in_bin = NULL;
+}
+
+static void picoquic_stored_ticket_index_rebuild(picoquic_quic_t* quic)
+{
+    picoquic_stored_ticket_index_t* index = &quic->ticket_index;
+    picoquic_stored_ticket_t* previous = NULL;
+    picoquic_stored_ticket_t* next = quic->p_first_ticket;
+    size_t nb_tickets = 0;
+    size_t nb_bins = PICOQUIC_STORED_INDEX_MIN_BINS;
+
+    /* Restore the back links, which are not maintained by code handling the list directly */
+    while (next != NULL) {
+        next->previous_ticket = previous;
+        next->index_hash = picoquic_stored_ticket_hash(quic, next->sni, next->sni_length, next->alpn, next->alpn_length);
+        next->next_in_bin = NULL;
+        previous = next;
+        next = next->next_ticket;
+        nb_tickets++;
+    }
+    index->last_ticket = previous;
+    index->nb_tickets = nb_tickets;
+    index->indexed_first = quic->p_first_ticket;
+
+    while (nb_bins < nb_tickets) {
+        nb_bins *= 2;
+    }
+    if (index->bins == NULL || index->nb_bins != nb_bins) {
+        if (index->bins != NULL) {
+            free(index->bins);
+        }
+        index->bins = (picoquic_stored_ticket_t**)malloc(nb_bins * sizeof(picoquic_stored_ticket_t*));
+        index->nb_bins = (index->bins == NULL) ? 0 : nb_bins;
+    }
+    if (index->bins != NULL) {
+        memset(index->bins, 0, index->nb_bins * sizeof(picoquic_stored_ticket_t*));
+        /* Insert from the tail, so each bin follows the order of the list */
+        next = index->last_ticket;
+        while (next != NULL) {
+            picoquic_stored_ticket_bin_insert(index, next);
+            next = next->previous_ticket;
+        }
+    }
+}
+
+static picoquic_stored_ticket_index_t* picoquic_stored_ticket_index_check(picoquic_quic_t* quic)
+{
+    picoquic_stored_ticket_index_t* index = &quic->ticket_index;
+
+    if (index->bins == NULL || index->indexed_first != quic->p_first_ticket) {
+        picoquic_stored_ticket_index_rebuild(quic);
+    }
+
+    return index;
+}
+
+static picoquic_stored_ticket_t* picoquic_stored_ticket_first_candidate(picoquic_quic_t* quic, uint64_t h)
+{
+    picoquic_stored_ticket_index_t* index = &quic->ticket_index;
+
+    return (index->bins == NULL) ? quic->p_first_ticket : index->bins[h & (index->nb_bins - 1)];
+}
+
+static picoquic_stored_ticket_t* picoquic_stored_ticket_next_candidate(picoquic_quic_t* quic, picoquic_stored_ticket_t* stored)
+{
+    return (quic->ticket_index.bins == NULL) ? stored->next_ticket : stored->next_in_bin;
+}
+
+static void picoquic_stored_ticket_push_front(picoquic_quic_t* quic, picoquic_stored_ticket_t* stored)
+{
+    picoquic_stored_ticket_index_t* index = &quic->ticket_index;
+
+    stored->previous_ticket = NULL;
+    stored->next_ticket = quic->p_first_ticket;
+    if (stored->next_ticket == NULL) {
+        index->last_ticket = stored;
+    }
+    else {
+        stored->next_ticket->previous_ticket = stored;
+    }
+    quic->p_first_ticket = stored;
+    index->indexed_first = stored;
+    picoquic_stored_ticket_bin_insert(index, stored);
+    index->nb_tickets++;
+}
+
+static void picoquic_stored_ticket_unlink(picoquic_quic_t* quic, picoquic_stored_ticket_t* stored)
+{
+    picoquic_stored_ticket_index_t* index = &quic->ticket_index;
+
+    picoquic_stored_ticket_bin_remove(index, stored);
+    if (stored->previous_ticket == NULL) {
+        quic->p_first_ticket = stored->next_ticket;
+        index->indexed_first = stored->next_ticket;
+    }
+    else {
+        stored->previous_ticket->next_ticket = stored->next_ticket;
+    }
+    if (stored->next_ticket == NULL) {
+        index->last_ticket = stored->previous_ticket;
+    }
+    else {
+        stored->next_ticket->previous_ticket = stored->previous_ticket;
+    }
+    stored->next_ticket = NULL;
+    stored->previous_ticket = NULL;
+    if (index->nb_tickets > 0) {
+        index->nb_tickets--;
+    }
+}
+
+static void picoquic_stored_ticket_delete(picoquic_quic_t* quic, picoquic_stored_ticket_t* stored)
+{
+    picoquic_stored_ticket_unlink(quic, stored);
+    memset(stored->ticket, 0, stored->ticket_length);
+    free(stored);
+}
+
+/* Evict the least recently used tickets, but never the one just stored */
+static void picoquic_stored_ticket_evict(picoquic_quic_t* quic, picoquic_stored_ticket_t* protected_ticket)
+{
+    picoquic_stored_ticket_index_t* index = &quic->ticket_index;
+
+    while (index->max_tickets > 0 && index->nb_tickets > index->max_tickets &&
+        index->last_ticket != NULL && index->last_ticket != protected_ticket) {
+        picoquic_stored_ticket_delete(quic, index->last_ticket);
+    }
+}
+
+/* Insert a new ticket at the head of the store, replacing the older tickets
+ * for the same SNI, ALPN and version */
+static void picoquic_stored_ticket_insert(picoquic_quic_t* quic, picoquic_stored_ticket_t* stored)
+{
+    picoquic_stored_ticket_index_t* index = picoquic_stored_ticket_index_check(quic);
+    picoquic_stored_ticket_t* next;
+
+    stored->index_hash = picoquic_stored_ticket_hash(quic, stored->sni, stored->sni_length, stored->alpn, stored->alpn_length);
+
+    next = picoquic_stored_ticket_first_candidate(quic, stored->index_hash);
+    while (next != NULL) {
+        picoquic_stored_ticket_t* candidate = next;
+        next = picoquic_stored_ticket_next_candidate(quic, next);
+        if (candidate->time_valid_until <= stored->time_valid_until &&
+            candidate->sni_length == stored->sni_length &&
+            candidate->alpn_length == stored->alpn_length &&
+            memcmp(candidate->sni, stored->sni, stored->sni_length) == 0 &&
+            memcmp(candidate->alpn, stored->alpn, stored->alpn_length) == 0 &&
+            candidate->version == stored->version) {
+            picoquic_stored_ticket_delete(quic, candidate);
+        }
+    }
+
+    picoquic_stored_ticket_push_front(quic, stored);
+    if (index->bins != NULL && index->nb_tickets > 2 * index->nb_bins) {
+        picoquic_stored_ticket_index_rebuild(quic);
+    }
+    picoquic_stored_ticket_evict(quic, stored);
+}
+
+void picoquic_set_ticket_store_max(picoquic_quic_t* quic, size_t max_tickets)
+{
+    quic->ticket_index.max_tickets = max_tickets;
+    (void)picoquic_stored_ticket_index_check(quic);
+    picoquic_stored_ticket_evict(quic, NULL);
+}
+
+void picoquic_free_ticket_index(picoquic_quic_t* quic)
+{
+    if (quic->ticket_index.bins != NULL) {
+        free(quic->ticket_index.bins);
+    }
+    memset(&quic->ticket_index, 0, sizeof(picoquic_stored_ticket_index_t));
+}
+
 int picoquic_store_ticket(picoquic_quic_t* quic,
     char const* sni, uint16_t sni_length, char const* alpn, uint16_t alpn_length,
     uint32_t version, const uint8_t* ip_addr, uint8_t ip_addr_length,
@@ -263,7 +474,6 @@ int picoquic_store_ticket(picoquic_quic_t* quic,
     uint8_t* ticket, uint16_t ticket_length, picoquic_tp_t const * tp)
 {
     uint64_t current_time = picoquic_get_tls_time(quic);
-    picoquic_stored_ticket_t** pp_first_ticket = &quic->p_first_ticket;
     int ret = 0;
 
     if (ticket_length < 17) {
@@ -293,31 +503,8 @@ int picoquic_store_ticket(picoquic_quic_t* quic,
                 ret = PICOQUIC_ERROR_MEMORY;
             }
             else {
-                picoquic_stored_ticket_t* next;
-                picoquic_stored_ticket_t** pprevious;
-
-                stored->next_ticket = next = *pp_first_ticket;
-                *pp_first_ticket = stored;
-                pprevious = &stored->next_ticket;
-
-                /* Now remove the old tickets for that SNI & ALPN & version */
-                while (next != NULL) {
-                    if (next->time_valid_until <= stored->time_valid_until &&
-                        next->sni_length == sni_length &&
-                        next->alpn_length == alpn_length &&
-                        memcmp(next->sni, sni, sni_length) == 0 &&
-                        memcmp(next->alpn, alpn, alpn_length) == 0 &&
-                        next->version == version) {
-                        picoquic_stored_ticket_t* deleted = next;
-                        next = next->next_ticket;
-                        *pprevious = next;
-                        memset(&deleted->ticket, 0, deleted->ticket_length);
-                        free(deleted);
-                    } else {
-                        pprevious = &next->next_ticket;
-                        next = next->next_ticket;
-                    }
-                }
+                picoquic_stored_ticket_insert(quic, stored);
+                picoquic_shared_store_publish_ticket(quic, stored);
             }
         }
     }
@@ -329,9 +516,13 @@ picoquic_stored_ticket_t* picoquic_get_stored_ticket(picoquic_quic_t * quic,
     char const* sni, uint16_t sni_length,
     char const* alpn, uint16_t alpn_length, uint32_t version, int need_unused, uint64_t ticket_id)
 {
-    picoquic_stored_ticket_t* next = quic->p_first_ticket;
+    picoquic_stored_ticket_t* next;
     uint64_t current_time = picoquic_get_tls_time(quic);
 
+    (void)picoquic_stored_ticket_index_check(quic);
+    next = picoquic_stored_ticket_first_candidate(quic,
+        picoquic_stored_ticket_hash(quic, sni, sni_length, alpn, alpn_length));
+
     while (next != NULL) {
         if (next->time_valid_until > current_time&&
             next->sni_length == sni_length &&
@@ -345,7 +536,20 @@ picoquic_stored_ticket_t* picoquic_get_stored_ticket(picoquic_quic_t * quic,
                 break;
             }
         }
-        next = next->next_ticket;
+        next = picoquic_stored_ticket_next_candidate(quic, next);
+    }
+
+    if (next == NULL && quic->shared_store != NULL) {
+        /* Another process may have received a matching ticket */
+        next = picoquic_shared_store_fetch_ticket(quic, sni, sni_length, alpn, alpn_length, version, ticket_id);
+        if (next != NULL) {
+            picoquic_stored_ticket_insert(quic, next);
+        }
+    }
+    else if (next != NULL && next->previous_ticket != NULL) {
+        /* Keep the list in least recently used order */
+        picoquic_stored_ticket_unlink(quic, next);
+        picoquic_stored_ticket_push_front(quic, next);
     }
 
     return next;
@@ -377,6 +581,9 @@ int picoquic_get_ticket_and_version(picoquic_quic_t * quic,
         *ticket = next->ticket;
         *ticket_length = next->ticket_length;
         next->was_used = mark_used;
+        if (mark_used) {
+            picoquic_shared_store_forget_ticket(quic, next);
+        }
     }
 
     return ret;
@@ -442,6 +649,7 @@ int picoquic_load_tickets(picoquic_quic_t* quic, char const* ticket_file_name)
     uint32_t record_size;
     uint32_t storage_size;
 
+    (void)picoquic_stored_ticket_index_check(quic);
 
     if ((F = picoquic_file_open_ex(ticket_file_name, "rb", &file_err)) == NULL) {
         ret = (file_err == ENOENT) ? PICOQUIC_ERROR_NO_SUCH_FILE : -1;
@@ -494,6 +702,10 @@ int picoquic_load_tickets(picoquic_quic_t* quic, char const* ticket_file_name)
 
     picoquic_file_close(F);
 
+    /* The loaded tickets were appended to the list, index them all at once */
+    picoquic_stored_ticket_index_rebuild(quic);
+    picoquic_stored_ticket_evict(quic, NULL);
+
     return ret;
 }
 
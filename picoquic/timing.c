@@ -22,6 +22,7 @@
 #include "picoquic_internal.h"
 #include "picoquic_unified_log.h"
 #include "tls_api.h"
+#include "picoquic_probes.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -107,6 +108,8 @@ static void picoquic_validate_bdp_seed(picoquic_cnx_t* cnx, picoquic_path_t* pat
                 cnx->congestion_alg->alg_notify(cnx, path_x,
                     picoquic_congestion_notification_seed_cwin,
                     &ack_state, current_time);
+                PICOQUIC_PROBE_CC_NOTIFY(cnx, path_x, picoquic_congestion_notification_seed_cwin);
+                picoquic_careful_resume_jump(cnx, path_x);
             }
         }
     }
@@ -204,6 +207,9 @@ void picoquic_update_path_rtt(picoquic_cnx_t* cnx, picoquic_path_t* old_path, pi
             }
         }
         old_path->rtt_sample = rtt_estimate;
+        if (cnx->quic->metrics != NULL) {
+            picoquic_metrics_histogram_add(&cnx->quic->metrics->live.rtt, rtt_estimate);
+        }
         /* During a measurement period, accumulate data:
         * - number of estimates since update
         * - sum of all estimates since update
@@ -307,12 +313,16 @@ void picoquic_update_path_rtt(picoquic_cnx_t* cnx, picoquic_path_t* old_path, pi
             cnx->congestion_alg->alg_notify(cnx, old_path,
                 picoquic_congestion_notification_rtt_measurement,
                 &ack_state, current_time);
+            PICOQUIC_PROBE_CC_NOTIFY(cnx, old_path, picoquic_congestion_notification_rtt_measurement);
         }
 
         /* On very first sample, apply the saved BDP */
         if (is_first) {
             picoquic_validate_bdp_seed(cnx, old_path, rtt_estimate, current_time);
         }
+        else if (cnx->is_careful_resume_unvalidated) {
+            picoquic_careful_resume_monitor(cnx, old_path);
+        }
         /* Perform a quality changed callback if needed */
         (void)picoquic_issue_path_quality_update(cnx, old_path);
     }
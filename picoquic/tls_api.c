@@ -104,6 +104,7 @@ picoquic_get_public_key_from_private_t picoquic_get_public_key_from_private_fn =
 picoquic_get_certificate_verifier_t picoquic_get_certificate_verifier_fn = NULL;
 picoquic_dispose_certificate_verifier_t picoquic_dispose_certificate_verifier_fn = NULL;
 picoquic_set_tls_root_certificates_t picoquic_set_tls_root_certificates_fn = NULL;
+picoquic_get_leaf_sign_verifier_t picoquic_get_leaf_sign_verifier_fn = NULL;
 picoquic_explain_crypto_error_t picoquic_explain_crypto_error_fn = NULL;
 picoquic_clear_crypto_errors_t picoquic_clear_crypto_errors_fn = NULL;
 picoquic_crypto_random_provider_t picoquic_crypto_random_provider_fn = NULL;
@@ -191,6 +192,7 @@ static void picoquic_tls_api_zero()
     picoquic_get_certificate_verifier_fn = NULL;
     picoquic_dispose_certificate_verifier_fn = NULL;
     picoquic_set_tls_root_certificates_fn = NULL;
+    picoquic_get_leaf_sign_verifier_fn = NULL;
 
     picoquic_explain_crypto_error_fn = NULL;
     picoquic_clear_crypto_errors_fn = NULL;
@@ -317,6 +319,11 @@ void picoquic_register_verify_certificate_fn(picoquic_get_certificate_verifier_t
     picoquic_set_tls_root_certificates_fn = set_tls_root_certificates_fn;
 }
 
+void picoquic_register_leaf_sign_verifier_fn(picoquic_get_leaf_sign_verifier_t get_leaf_sign_verifier_fn)
+{
+    picoquic_get_leaf_sign_verifier_fn = get_leaf_sign_verifier_fn;
+}
+
 void picoquic_register_explain_crypto_error_fn(picoquic_explain_crypto_error_t explain_crypto_error_fn,
     picoquic_clear_crypto_errors_t clear_crypto_errors_fn)
 {
@@ -585,6 +592,8 @@ int picoquic_set_private_key_from_file(picoquic_quic_t* quic, char const* file_n
 */
 void picoquic_dispose_sign_certificate(ptls_context_t* ctx)
 {
+    /* Stop the asynchronous signer, if any, before disposing of the wrapped object */
+    ctx->sign_certificate = (ptls_sign_certificate_t*)picoquic_async_signer_release(ctx->sign_certificate);
     if (ctx->sign_certificate != NULL) {
         if (picoquic_dispose_sign_certificate_fn != NULL) {
             /* we expect the dispose function to free dependencies,
@@ -637,9 +646,12 @@ int picoquic_set_tls_root_certificates(picoquic_quic_t* quic, ptls_iovec_t* cert
     int ret = -1;
 
     if (picoquic_set_tls_root_certificates_fn != NULL) {
+        /* The crypto provider expects its own verifier in the context */
+        picoquic_cert_cache_unwrap(quic);
         if ((ret = picoquic_set_tls_root_certificates_fn(quic->tls_master_ctx, certs, count)) == 0){
             quic->is_cert_store_not_empty = 1;
         }
+        picoquic_cert_cache_wrap(quic);
     }
     return ret;
 }
@@ -754,6 +766,148 @@ uint64_t picoquic_crypto_uniform_random(picoquic_quic_t* quic, uint64_t rnd_max)
     return rnd % rnd_max;
 }
 
+/*
+ * Buffered crypto random generator.
+ *
+ * Connection IDs, path challenges, token identifiers and similar values
+ * must be unpredictable, but they are not keys, and calling the provider
+ * for each of them is costly when many connections are created: each call
+ * goes through the provider locks, and sometimes through a system call.
+ * Instead, each QUIC context keeps a ChaCha20 generator (RFC 8439 block
+ * function) and a buffer of PICOQUIC_RANDOM_POOL_SIZE bytes.
+ *
+ * Each refill runs the block function with the current key, then uses the
+ * first 32 bytes of output as the next key ("fast key erasure"). Bytes are
+ * zeroed once delivered, so the content of the context does not reveal
+ * previous outputs. The key is mixed with fresh provider bytes on first
+ * use and after each PICOQUIC_RANDOM_RESEED_BYTES.
+ *
+ * The context is only used by the thread that runs the QUIC context.
+ */
+
+#define PICOQUIC_CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define PICOQUIC_CHACHA_QR(a, b, c, d) \
+    a += b; d ^= a; d = PICOQUIC_CHACHA_ROTL(d, 16); \
+    c += d; b ^= c; b = PICOQUIC_CHACHA_ROTL(b, 12); \
+    a += b; d ^= a; d = PICOQUIC_CHACHA_ROTL(d, 8); \
+    c += d; b ^= c; b = PICOQUIC_CHACHA_ROTL(b, 7)
+
+void picoquic_chacha20_block(const uint32_t key[8], uint32_t counter, const uint32_t nonce[3], uint8_t out[64])
+{
+    uint32_t input[16];
+    uint32_t x[16];
+
+    input[0] = 0x61707865;
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    memcpy(&input[4], key, 32);
+    input[12] = counter;
+    input[13] = nonce[0];
+    input[14] = nonce[1];
+    input[15] = nonce[2];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        PICOQUIC_CHACHA_QR(x[0], x[4], x[8], x[12]);
+        PICOQUIC_CHACHA_QR(x[1], x[5], x[9], x[13]);
+        PICOQUIC_CHACHA_QR(x[2], x[6], x[10], x[14]);
+        PICOQUIC_CHACHA_QR(x[3], x[7], x[11], x[15]);
+        PICOQUIC_CHACHA_QR(x[0], x[5], x[10], x[15]);
+        PICOQUIC_CHACHA_QR(x[1], x[6], x[11], x[12]);
+        PICOQUIC_CHACHA_QR(x[2], x[7], x[8], x[13]);
+        PICOQUIC_CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + input[i];
+        out[4 * i] = (uint8_t)v;
+        out[4 * i + 1] = (uint8_t)(v >> 8);
+        out[4 * i + 2] = (uint8_t)(v >> 16);
+        out[4 * i + 3] = (uint8_t)(v >> 24);
+    }
+}
+
+static void picoquic_random_pool_refill(picoquic_quic_t* quic)
+{
+    picoquic_random_pool_t* pool = &quic->random_pool;
+    uint32_t nonce[3] = { 0, 0, 0 };
+
+    if (pool->nb_reseeds == 0 || pool->bytes_since_reseed >= PICOQUIC_RANDOM_RESEED_BYTES) {
+        uint32_t seed[8];
+
+        picoquic_crypto_random(quic, seed, sizeof(seed));
+        for (int i = 0; i < 8; i++) {
+            pool->key[i] ^= seed[i];
+        }
+        memset(seed, 0, sizeof(seed));
+        pool->bytes_since_reseed = 0;
+        pool->nb_reseeds++;
+    }
+
+    for (uint32_t counter = 0; counter < PICOQUIC_RANDOM_POOL_SIZE / 64; counter++) {
+        picoquic_chacha20_block(pool->key, counter, nonce, pool->buffer + 64 * counter);
+    }
+    /* Fast key erasure: the first bytes of output become the next key */
+    memcpy(pool->key, pool->buffer, sizeof(pool->key));
+    memset(pool->buffer, 0, sizeof(pool->key));
+    pool->available = PICOQUIC_RANDOM_POOL_SIZE - sizeof(pool->key);
+}
+
+void picoquic_buffered_random(picoquic_quic_t* quic, void* buf, size_t len)
+{
+    picoquic_random_pool_t* pool = &quic->random_pool;
+    uint8_t* x = (uint8_t*)buf;
+
+    while (len > 0) {
+        size_t copied;
+        uint8_t* source;
+
+        if (pool->available == 0) {
+            picoquic_random_pool_refill(quic);
+        }
+        copied = (len > pool->available) ? pool->available : len;
+        source = pool->buffer + PICOQUIC_RANDOM_POOL_SIZE - pool->available;
+        memcpy(x, source, copied);
+        memset(source, 0, copied);
+        pool->available -= copied;
+        pool->bytes_since_reseed += copied;
+        x += copied;
+        len -= copied;
+    }
+}
+
+uint64_t picoquic_buffered_random_64(picoquic_quic_t* quic)
+{
+    uint64_t rnd;
+
+    picoquic_buffered_random(quic, &rnd, sizeof(rnd));
+
+    return rnd;
+}
+
+uint64_t picoquic_buffered_uniform_random(picoquic_quic_t* quic, uint64_t rnd_max)
+{
+    uint64_t rnd;
+    uint64_t rnd_min = UINT64_MAX % rnd_max;
+
+    do {
+        rnd = picoquic_buffered_random_64(quic);
+    } while (rnd < rnd_min);
+
+    return rnd % rnd_max;
+}
+
+/* Forget the state, called when the context is deleted */
+void picoquic_buffered_random_clear(picoquic_quic_t* quic)
+{
+    volatile uint8_t* x = (volatile uint8_t*)&quic->random_pool;
+
+    for (size_t i = 0; i < sizeof(picoquic_random_pool_t); i++) {
+        x[i] = 0;
+    }
+}
+
 /*
  * Non crypto public random generator. This is meant to provide good enough randomness
  * without disclosing the state of the crypto random number generator. This is
@@ -787,13 +941,17 @@ static uint64_t public_random_obfuscator = 0x5555555555555555ull;
 static uint64_t picoquic_public_random_step(void)
 {
     uint64_t s1;
-    const uint64_t s0 = public_random_seed[public_random_index++];
-    public_random_index &= 15;
-    s1 = public_random_seed[public_random_index];
+    /* Work on a local copy of the index, so that it stays in range if several
+     * threads use the generator at the same time, e.g., parallel simulations. */
+    int index = public_random_index & 15;
+    const uint64_t s0 = public_random_seed[index];
+    index = (index + 1) & 15;
+    public_random_index = index;
+    s1 = public_random_seed[index];
     s1 ^= (s1 << 31); // a
     s1 ^= (s1 >> 11); // b
     s1 ^= (s0 ^ (s0 >> 30)); // c
-    public_random_seed[public_random_index] = s1;
+    public_random_seed[index] = s1;
     return s1;
 }
 
@@ -1053,23 +1211,33 @@ int picoquic_server_encrypt_ticket_call_back(ptls_encrypt_ticket_t* encrypt_tick
     /* Assume that the keys are in the quic context 
      * The tickets are composed of a 64 bit "sequence number" 
      * followed by the result of the clear text encryption.
+     * If the ticket key ring is used, the sequence number is preceded
+     * by the ID of the key, which is also authenticated.
      */
     int ret = 0;
     picoquic_quic_t** ppquic = (picoquic_quic_t**)(((char*)encrypt_ticket_ctx) + sizeof(ptls_encrypt_ticket_t));
     picoquic_quic_t* quic = *ppquic;
+    int use_key_ring = picoquic_ticket_key_ring_is_active(quic);
+    size_t header_length = (use_key_ring) ? 9 : 8;
 
     if (is_encrypt != 0) {
-        ptls_aead_context_t* aead_enc = (ptls_aead_context_t*)quic->aead_encrypt_ticket_ctx;
+        uint8_t key_id = 0;
+        ptls_aead_context_t* aead_enc = (ptls_aead_context_t*)((use_key_ring) ?
+            picoquic_ticket_key_ring_encrypt_ctx(quic, &key_id) : quic->aead_encrypt_ticket_ctx);
         /* Encoding*/
         if (aead_enc == NULL) {
             ret = -1;
-        } else if ((ret = ptls_buffer_reserve(dst, 8 + 4 + src.len + aead_enc->algo->tag_size)) == 0) {
+        } else if ((ret = ptls_buffer_reserve(dst, header_length + 4 + src.len + aead_enc->algo->tag_size)) == 0) {
             /* Create and store the ticket sequence number */
             uint32_t version_number = picoquic_supported_versions[quic->cnx_in_progress->version_index].version;
             uint64_t seq_num = picoquic_public_random_64();
+            const uint8_t* auth_data = dst->base + dst->off;
             size_t start_off;
             size_t data_length;
 
+            if (use_key_ring) {
+                dst->base[dst->off++] = key_id;
+            }
             picoformat_64(dst->base + dst->off, seq_num);
             dst->off += 8;
             start_off = dst->off;
@@ -1081,25 +1249,34 @@ int picoquic_server_encrypt_ticket_call_back(ptls_encrypt_ticket_t* encrypt_tick
             data_length += 4;
             /* Run AEAD encryption */
             dst->off += ptls_aead_encrypt(aead_enc, dst->base + dst->off,
-                dst->base + start_off, data_length, seq_num, NULL, 0);
+                dst->base + start_off, data_length, seq_num, auth_data, header_length - 8);
             /* Remember issued ticket ID in connection context */
             quic->cnx_in_progress->issued_ticket_id = seq_num;
         }
     } else {
         ptls_aead_context_t* aead_dec = (ptls_aead_context_t*)quic->aead_decrypt_ticket_ctx;
+
+        if (use_key_ring) {
+            /* Select the key from its ID, without trying the others */
+            aead_dec = (src.len > 0) ? (ptls_aead_context_t*)picoquic_ticket_key_ring_decrypt_ctx(quic, src.base[0]) : NULL;
+            if (aead_dec == NULL) {
+                picoquic_log_app_message(quic->cnx_in_progress, "%s",
+                    "Session ticket key is unknown");
+            }
+        }
         /* Decoding*/
         if (aead_dec == NULL) {
             ret = -1;
-        } else if (src.len < 8 + 4 + aead_dec->algo->tag_size) {
+        } else if (src.len < header_length + 4 + aead_dec->algo->tag_size) {
             ret = -1;
         } else if ((ret = ptls_buffer_reserve(dst, src.len)) == 0) {
             /* Decode the ticket sequence number */
-            uint64_t seq_num = PICOPARSE_64(src.base);
+            uint64_t seq_num = PICOPARSE_64(src.base + header_length - 8);
             /* Decrypt */
             size_t decrypted = ptls_aead_decrypt(aead_dec, dst->base + dst->off,
-                src.base + 8, src.len - 8, seq_num, NULL, 0);
+                src.base + header_length, src.len - header_length, seq_num, src.base, header_length - 8);
 
-            if (decrypted > src.len - 8) {
+            if (decrypted > src.len - header_length) {
                 /* decryption error */
                 ret = -1;
                 picoquic_log_app_message(quic->cnx_in_progress, "%s",
@@ -1120,6 +1297,17 @@ int picoquic_server_encrypt_ticket_call_back(ptls_encrypt_ticket_t* encrypt_tick
                         "Session ticket properly decrypted");
                     /* Remember resumed ticket ID in connection context */
                     quic->cnx_in_progress->resumed_ticket_id = seq_num;
+                    /* Refuse early data if the ticket was already used. */
+                    if (quic->anti_replay != NULL &&
+                        picoquic_anti_replay_check(quic, seq_num, picoquic_get_quic_time(quic))) {
+                        picoquic_log_app_message(quic->cnx_in_progress, "%s",
+                            "Session ticket replay, early data refused");
+#ifdef PTLS_ERROR_REJECT_EARLY_DATA
+                        ret = PTLS_ERROR_REJECT_EARLY_DATA;
+#else
+                        ret = -1;
+#endif
+                    }
                     /* Remember rtt and cwin from ticket */
                     server_ticket = picoquic_retrieve_issued_ticket(quic, seq_num);
                     if (server_ticket != NULL && server_ticket->cwin > 0) {
@@ -1201,6 +1389,10 @@ int picoquic_enable_custom_verify_certificate_callback(picoquic_quic_t* quic)
 void picoquic_dispose_verify_certificate_callback(picoquic_quic_t* quic) {
     ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
 
+    /* Chains validated by the old verifier shall not be trusted by the next one */
+    picoquic_cert_cache_unwrap(quic);
+    picoquic_cert_cache_flush(quic);
+
     if (ctx->verify_certificate != NULL) {
         if (quic->free_verify_certificate_callback_fn != NULL) {
             picoquic_dispose_certificate_verifier_t disposer =
@@ -1227,6 +1419,7 @@ void picoquic_tls_set_verify_certificate_callback(picoquic_quic_t* quic,
     ctx->verify_certificate = cb;
     quic->is_cert_store_not_empty = 1;
     quic->free_verify_certificate_callback_fn = free_fn;
+    picoquic_cert_cache_wrap(quic);
 }
 
 /* set key from secret: this is used to create AEAD contexts and PN encoding contexts
@@ -1249,7 +1442,11 @@ static int picoquic_set_aead_from_secret(void ** v_aead,ptls_cipher_suite_t * ci
     return ret;
 }
 
-static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, ptls_cipher_suite_t * cipher, int is_enc, const void *secret, const char *prefix_label)
+/* When v_pn_ecb is not NULL, also create an ECB context with the header protection key,
+ * so that the masks of several packets can be computed in a single call. This only
+ * works with AES, for which the mask is the encryption of the sample.
+ */
+static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, void ** v_pn_ecb, ptls_cipher_suite_t * cipher, int is_enc, const void *secret, const char *prefix_label)
 {
     uint8_t pnekey[PTLS_MAX_SECRET_SIZE];
     int ret;
@@ -1258,6 +1455,10 @@ static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, ptls_cipher_suite_t
         ptls_cipher_free((ptls_cipher_context_t *)*v_pn_enc);
         *v_pn_enc = NULL;
     }
+    if (v_pn_ecb != NULL && *v_pn_ecb != NULL) {
+        ptls_cipher_free((ptls_cipher_context_t *)*v_pn_ecb);
+        *v_pn_ecb = NULL;
+    }
 
     if ((ret = ptls_hkdf_expand_label(cipher->hash, pnekey, 
         cipher->aead->ctr_cipher->key_size, ptls_iovec_init(secret, cipher->hash->digest_size), 
@@ -1265,6 +1466,11 @@ static int picoquic_set_pn_enc_from_secret(void ** v_pn_enc, ptls_cipher_suite_t
         if ((*v_pn_enc = ptls_cipher_new(cipher->aead->ctr_cipher, is_enc, pnekey)) == NULL) {
             ret = PTLS_ERROR_NO_MEMORY;
         }
+        else if (v_pn_ecb != NULL && cipher->aead->ecb_cipher != NULL &&
+            cipher->aead->ecb_cipher->key_size == cipher->aead->ctr_cipher->key_size) {
+            /* Failure to create the ECB context is not an error, the masks will be computed one by one */
+            *v_pn_ecb = ptls_cipher_new(cipher->aead->ecb_cipher, 1, pnekey);
+        }
     }
     
     return ret;
@@ -1288,13 +1494,13 @@ static int picoquic_set_key_from_secret(ptls_cipher_suite_t * cipher, int is_enc
         ret = picoquic_set_aead_from_secret(&ctx->aead_encrypt, cipher, is_enc, secret, prefix_label);
         
         if (ret == 0 && !is_rotation) {
-            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_enc, cipher, is_enc, secret, prefix_label);
+            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_enc, NULL, cipher, is_enc, secret, prefix_label);
         }
     } else {
         ret = picoquic_set_aead_from_secret(&ctx->aead_decrypt, cipher, is_enc, secret, prefix_label);
         
         if (ret == 0 && !is_rotation) {
-            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_dec, cipher, is_enc, secret, prefix_label);
+            ret = picoquic_set_pn_enc_from_secret(&ctx->pn_dec, &ctx->pn_dec_ecb, cipher, is_enc, secret, prefix_label);
         }
     }
 
@@ -1437,20 +1643,21 @@ static int picoquic_compute_initial_secrets(picoquic_quic_t * quic, int version_
     return ret;
 }
 
-int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx)
+static int picoquic_set_initial_keys(picoquic_quic_t* quic, int version_index, picoquic_connection_id_t* initial_cnxid,
+    int client_mode, picoquic_crypto_context_t* crypto_context)
 {
     int ret = 0;
-    const char *prefix_label = picoquic_supported_versions[cnx->version_index].tls_prefix_label;
+    const char *prefix_label = picoquic_supported_versions[version_index].tls_prefix_label;
     ptls_cipher_suite_t* cipher = NULL;
     uint8_t client_secret[256];
     uint8_t server_secret[256];
     uint8_t *secret1, *secret2;
 
-    ret = picoquic_compute_initial_secrets(cnx->quic, cnx->version_index, &cnx->initial_cnxid, &cipher, client_secret, server_secret);
+    ret = picoquic_compute_initial_secrets(quic, version_index, initial_cnxid, &cipher, client_secret, server_secret);
 
     /* derive the initial keys */
     if (ret == 0) {
-        if (!cnx->client_mode) {
+        if (!client_mode) {
             secret1 = server_secret;
             secret2 = client_secret;
         }
@@ -1459,13 +1666,89 @@ int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx)
             secret2 = server_secret;
         }
         
-        ret = picoquic_set_key_from_secret(cipher, 1, 0, &cnx->crypto_context[0], secret1, prefix_label);
+        ret = picoquic_set_key_from_secret(cipher, 1, 0, crypto_context, secret1, prefix_label);
 
         if (ret == 0) {
-            ret = picoquic_set_key_from_secret(cipher, 0, 0, &cnx->crypto_context[0], secret2, prefix_label);
+            ret = picoquic_set_key_from_secret(cipher, 0, 0, crypto_context, secret2, prefix_label);
+        }
+    }
+
+    return ret;
+}
+
+/* Cache of the server side Initial keys for the last Initial DCID.
+ * The keys are computed when screening the first Initial packet of a
+ * connection attempt. They are reused by the coalesced or repeated
+ * Initial packets carrying the same DCID, e.g., while waiting for a
+ * Retry, and then handed over to the connection context when the
+ * connection is created, instead of being derived again.
+ */
+static int picoquic_initial_key_cache_match(picoquic_initial_key_cache_t* cache, int version_index,
+    picoquic_connection_id_t* initial_cnxid)
+{
+    return (cache != NULL && cache->crypto_context.aead_decrypt != NULL && cache->version_index == version_index &&
+        picoquic_compare_connection_id(&cache->initial_cnxid, initial_cnxid) == 0);
+}
+
+picoquic_crypto_context_t* picoquic_initial_key_cache_get(picoquic_quic_t* quic, int version_index,
+    picoquic_connection_id_t* initial_cnxid)
+{
+    picoquic_crypto_context_t* crypto_context = NULL;
+
+    if (quic->initial_key_cache == NULL &&
+        (quic->initial_key_cache = (picoquic_initial_key_cache_t*)malloc(sizeof(picoquic_initial_key_cache_t))) != NULL) {
+        memset(quic->initial_key_cache, 0, sizeof(picoquic_initial_key_cache_t));
+    }
+
+    if (quic->initial_key_cache != NULL) {
+        picoquic_initial_key_cache_t* cache = quic->initial_key_cache;
+
+        if (picoquic_initial_key_cache_match(cache, version_index, initial_cnxid)) {
+            cache->nb_hits++;
+            crypto_context = &cache->crypto_context;
+        }
+        else {
+            picoquic_crypto_context_free(&cache->crypto_context);
+            if (picoquic_set_initial_keys(quic, version_index, initial_cnxid, 0, &cache->crypto_context) == 0) {
+                cache->version_index = version_index;
+                cache->initial_cnxid = *initial_cnxid;
+                cache->nb_derived++;
+                crypto_context = &cache->crypto_context;
+            }
+            else {
+                picoquic_crypto_context_free(&cache->crypto_context);
+            }
         }
     }
 
+    return crypto_context;
+}
+
+void picoquic_initial_key_cache_free(picoquic_quic_t* quic)
+{
+    if (quic->initial_key_cache != NULL) {
+        picoquic_crypto_context_free(&quic->initial_key_cache->crypto_context);
+        free(quic->initial_key_cache);
+        quic->initial_key_cache = NULL;
+    }
+}
+
+int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+    picoquic_initial_key_cache_t* cache = cnx->quic->initial_key_cache;
+
+    if (!cnx->client_mode && picoquic_initial_key_cache_match(cache, cnx->version_index, &cnx->initial_cnxid)) {
+        /* Take the keys computed when the Initial packet was screened */
+        cache->nb_hits++;
+        cnx->crypto_context[0] = cache->crypto_context;
+        memset(&cache->crypto_context, 0, sizeof(picoquic_crypto_context_t));
+    }
+    else {
+        ret = picoquic_set_initial_keys(cnx->quic, cnx->version_index, &cnx->initial_cnxid, cnx->client_mode,
+            &cnx->crypto_context[0]);
+    }
+
     return ret;
 }
 
@@ -1495,7 +1778,7 @@ int picoquic_get_initial_aead_context(picoquic_quic_t * quic, int version_index,
 
         ret = picoquic_set_aead_from_secret(aead_ctx, cipher, is_enc, selected_secret, prefix_label);
         if (ret == 0) {
-            ret = picoquic_set_pn_enc_from_secret(pn_enc_ctx, cipher, is_enc, selected_secret, prefix_label);
+            ret = picoquic_set_pn_enc_from_secret(pn_enc_ctx, NULL, cipher, is_enc, selected_secret, prefix_label);
         }
     }
     return ret;
@@ -1530,6 +1813,14 @@ int picoquic_rotate_app_secret(ptls_cipher_suite_t * cipher, uint8_t * secret, c
 }
 
 
+/* The cipher suite of the application keys is obtained from the TLS
+ * session, unless the secrets were imported from another server.
+ */
+static ptls_cipher_suite_t* picoquic_get_app_cipher(picoquic_tls_ctx_t* tls_ctx)
+{
+    return (tls_ctx->imported_cipher != NULL) ? tls_ctx->imported_cipher : ptls_get_cipher(tls_ctx->tls);
+}
+
 uint8_t * picoquic_get_app_secret(picoquic_cnx_t* cnx, int is_enc)
 {
     picoquic_tls_ctx_t * tls_ctx = (picoquic_tls_ctx_t *)cnx->tls_ctx;
@@ -1541,16 +1832,62 @@ size_t picoquic_get_app_secret_size(picoquic_cnx_t* cnx)
 {
     picoquic_tls_ctx_t * tls_ctx = (picoquic_tls_ctx_t *)cnx->tls_ctx;
 
-    ptls_cipher_suite_t * cipher = ptls_get_cipher(tls_ctx->tls);
+    ptls_cipher_suite_t * cipher = picoquic_get_app_cipher(tls_ctx);
 
     return (cipher->hash->digest_size);
 }
 
+/* Identifier of the cipher suite used for the application keys, or -1 if
+ * the keys are not available yet.
+ */
+int picoquic_get_app_cipher_suite_id(picoquic_cnx_t* cnx)
+{
+    picoquic_tls_ctx_t* tls_ctx = (picoquic_tls_ctx_t*)cnx->tls_ctx;
+    ptls_cipher_suite_t* cipher = (tls_ctx == NULL) ? NULL : picoquic_get_app_cipher(tls_ctx);
+
+    return (cipher == NULL || cnx->crypto_context[picoquic_epoch_1rtt].aead_encrypt == NULL) ? -1 : (int)cipher->id;
+}
+
+/* Install the application keys of a connection handed off by another
+ * server, see picoquic_import_cnx. The secrets are those of the current
+ * key phase, and are kept so that later key updates can be computed
+ * although the TLS session did not run in this process.
+ */
+int picoquic_import_app_traffic_secrets(picoquic_cnx_t* cnx, int cipher_suite_id,
+    const uint8_t* secret_enc, const uint8_t* secret_dec, size_t secret_length)
+{
+    int ret = 0;
+    picoquic_tls_ctx_t* tls_ctx = (picoquic_tls_ctx_t*)cnx->tls_ctx;
+    /* Suite 0 would select the default list, not a specific suite */
+    ptls_cipher_suite_t* cipher = (cipher_suite_id <= 0) ? NULL :
+        picoquic_get_cipher_suite_by_id(cipher_suite_id, cnx->quic->use_low_memory);
+    const char* prefix_label = picoquic_supported_versions[cnx->version_index].tls_prefix_label;
+
+    if (cipher == NULL || cipher->hash->digest_size != secret_length || secret_length > PTLS_MAX_DIGEST_SIZE) {
+        ret = PICOQUIC_ERROR_CANNOT_COMPUTE_KEY;
+    }
+    else {
+        picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_1rtt]);
+        if ((ret = picoquic_set_key_from_secret(cipher, 1, 0, &cnx->crypto_context[picoquic_epoch_1rtt], secret_enc, prefix_label)) == 0 &&
+            (ret = picoquic_set_key_from_secret(cipher, 0, 0, &cnx->crypto_context[picoquic_epoch_1rtt], secret_dec, prefix_label)) == 0) {
+            memcpy(tls_ctx->app_secret_enc, secret_enc, secret_length);
+            memcpy(tls_ctx->app_secret_dec, secret_dec, secret_length);
+            tls_ctx->imported_cipher = cipher;
+        }
+        else {
+            picoquic_crypto_context_free(&cnx->crypto_context[picoquic_epoch_1rtt]);
+            ret = PICOQUIC_ERROR_CANNOT_COMPUTE_KEY;
+        }
+    }
+
+    return ret;
+}
+
 int picoquic_compute_new_rotated_keys(picoquic_cnx_t * cnx)
 {
     int ret = 0;
     picoquic_tls_ctx_t * tls_ctx = (picoquic_tls_ctx_t *)cnx->tls_ctx;
-    ptls_cipher_suite_t * cipher = ptls_get_cipher(tls_ctx->tls);
+    ptls_cipher_suite_t * cipher = picoquic_get_app_cipher(tls_ctx);
     const char *prefix_label = picoquic_supported_versions[cnx->version_index].tls_prefix_label;
     const char *traffic_update_label = picoquic_supported_versions[cnx->version_index].tls_traffic_update_label;
 
@@ -1656,6 +1993,51 @@ void picoquic_crypto_context_free(picoquic_crypto_context_t * ctx)
         ptls_cipher_free((ptls_cipher_context_t *)ctx->pn_dec);
         ctx->pn_dec = NULL;
     }
+
+    if (ctx->pn_dec_ecb != NULL) {
+        ptls_cipher_free((ptls_cipher_context_t *)ctx->pn_dec_ecb);
+        ctx->pn_dec_ecb = NULL;
+    }
+}
+
+/* Set a crypto context from a traffic secret obtained outside of the
+ * handshake, e.g., from a key log file. This is used by tools that
+ * decrypt captured traffic. The secret length must match the hash of
+ * the cipher suite. If is_rotation is set, only the AEAD context is
+ * replaced, as after a key update. */
+int picoquic_set_crypto_context_from_secret(picoquic_crypto_context_t* ctx, int cipher_suite_id, int version_index,
+    int is_enc, int is_rotation, const uint8_t* secret, size_t secret_length)
+{
+    int ret = 0;
+    ptls_cipher_suite_t* cipher = picoquic_get_cipher_suite_by_id(cipher_suite_id, 0);
+
+    if (cipher == NULL || cipher->hash->digest_size != secret_length ||
+        version_index < 0 || (size_t)version_index >= picoquic_nb_supported_versions) {
+        ret = PICOQUIC_ERROR_CANNOT_COMPUTE_KEY;
+    }
+    else {
+        ret = picoquic_set_key_from_secret(cipher, is_enc, is_rotation, ctx, secret,
+            picoquic_supported_versions[version_index].tls_prefix_label);
+    }
+
+    return ret;
+}
+
+/* Compute the next generation of a traffic secret, as in picoquic_rotate_app_secret */
+int picoquic_rotate_secret_by_id(int cipher_suite_id, int version_index, uint8_t* secret, size_t secret_length)
+{
+    int ret = 0;
+    ptls_cipher_suite_t* cipher = picoquic_get_cipher_suite_by_id(cipher_suite_id, 0);
+
+    if (cipher == NULL || cipher->hash->digest_size != secret_length ||
+        version_index < 0 || (size_t)version_index >= picoquic_nb_supported_versions) {
+        ret = PICOQUIC_ERROR_CANNOT_COMPUTE_KEY;
+    }
+    else {
+        ret = picoquic_rotate_app_secret(cipher, secret, picoquic_supported_versions[version_index].tls_traffic_update_label);
+    }
+
+    return ret;
 }
 
 /*
@@ -1790,6 +2172,8 @@ int picoquic_master_tlscontext(picoquic_quic_t* quic,
         if (ret == 0) {
             quic->tls_master_ctx = ctx;
             picoquic_public_random_seed(quic);
+            /* Certificate compression is used if compression libraries are available */
+            (void)picoquic_set_certificate_compression(quic, 1);
         } else {
             quic->tls_master_ctx = ctx;
             picoquic_master_tlscontext_free(quic);
@@ -1817,6 +2201,8 @@ void picoquic_master_tlscontext_free(picoquic_quic_t* quic)
     if (quic->tls_master_ctx != NULL) {
         ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
 
+        (void)picoquic_set_certificate_compression(quic, 0);
+
         if (quic->p_simulated_time != NULL && ctx->get_time != NULL) {
             free(ctx->get_time);
             ctx->get_time = NULL;
@@ -1824,6 +2210,8 @@ void picoquic_master_tlscontext_free(picoquic_quic_t* quic)
 
         free_certificates_list(ctx->certificates.list, ctx->certificates.count);
 
+        picoquic_key_share_pool_release(quic);
+
         picoquic_dispose_sign_certificate(ctx);
 
         picoquic_dispose_verify_certificate_callback(quic);
@@ -2111,6 +2499,8 @@ static int picoquic_add_to_tls_stream(picoquic_cnx_t* cnx, const uint8_t* data,
         }
         else {
             stream_data->bytes = (uint8_t*)malloc(length);
+            stream_data->release_fn = NULL;
+            stream_data->release_ctx = NULL;
 
             if (stream_data->bytes == NULL) {
                 free(stream_data);
@@ -2125,6 +2515,7 @@ static int picoquic_add_to_tls_stream(picoquic_cnx_t* cnx, const uint8_t* data,
                 stream_data->length = length;
                 stream_data->offset = 0;
                 stream_data->next_stream_data = NULL;
+                picoquic_memory_charge(cnx, picoquic_memory_stream_send, PICOQUIC_STREAM_QUEUE_NODE_CHARGE(stream_data));
 
                 while (next != NULL) {
                     pprevious = &next->next_stream_data;
@@ -2282,7 +2673,7 @@ void * picoquic_pn_enc_create_for_test(const uint8_t * secret, const char *prefi
     ptls_cipher_suite_t *cipher = picoquic_get_aes128gcm_sha256(1);
     void *v_pn_enc = NULL;
     
-    (void)picoquic_set_pn_enc_from_secret(&v_pn_enc, cipher, 1, secret, prefix_label);
+    (void)picoquic_set_pn_enc_from_secret(&v_pn_enc, NULL, cipher, 1, secret, prefix_label);
 
     return v_pn_enc;
 }
@@ -2332,9 +2723,12 @@ void * picoquic_setup_test_aead_context(int is_encrypt, const uint8_t * secret,
     return v_aead;
 }
 
-int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
-    ptls_context_t* tls_ctx,
-    const uint8_t* secret, size_t secret_length)
+/* Create the pair of AEAD contexts used to protect tickets and tokens.
+ * The secret is truncated or padded with zeroes to the hash size, or
+ * drawn at random if not provided.
+ */
+static int picoquic_create_ticket_aead_pair(ptls_context_t* tls_ctx, const uint8_t* secret, size_t secret_length,
+    void** aead_encrypt, void** aead_decrypt)
 {
     int ret = 0;
     uint8_t temp_secret[256]; /* secret_max */
@@ -2351,9 +2745,9 @@ int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
         }
 
         /* Create the AEAD contexts */
-        ret = picoquic_set_aead_from_secret(&quic->aead_encrypt_ticket_ctx, cipher, 1, temp_secret, "random label");
+        ret = picoquic_set_aead_from_secret(aead_encrypt, cipher, 1, temp_secret, "random label");
         if (ret == 0) {
-            ret = picoquic_set_aead_from_secret(&quic->aead_decrypt_ticket_ctx, cipher, 0, temp_secret, "random label");
+            ret = picoquic_set_aead_from_secret(aead_decrypt, cipher, 0, temp_secret, "random label");
         }
 
         /* erase the temporary secret */
@@ -2362,6 +2756,57 @@ int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
     return ret;
 }
 
+int picoquic_server_setup_ticket_aead_contexts(picoquic_quic_t* quic,
+    ptls_context_t* tls_ctx,
+    const uint8_t* secret, size_t secret_length)
+{
+    return picoquic_create_ticket_aead_pair(tls_ctx, secret, secret_length,
+        &quic->aead_encrypt_ticket_ctx, &quic->aead_decrypt_ticket_ctx);
+}
+
+/* Prebuild the AEAD contexts of a ticket key ring entry, see ticket_keys.c */
+int picoquic_create_ticket_key_contexts(const uint8_t* key, size_t key_length, void** aead_encrypt, void** aead_decrypt)
+{
+    int ret = -1;
+
+    *aead_encrypt = NULL;
+    *aead_decrypt = NULL;
+
+    if (key != NULL && key_length > 0) {
+        ret = picoquic_create_ticket_aead_pair(NULL, key, key_length, aead_encrypt, aead_decrypt);
+        if (ret != 0) {
+            if (*aead_encrypt != NULL) {
+                picoquic_aead_free(*aead_encrypt);
+                *aead_encrypt = NULL;
+            }
+            if (*aead_decrypt != NULL) {
+                picoquic_aead_free(*aead_decrypt);
+                *aead_decrypt = NULL;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Replace the key used for encrypting session tickets and tokens,
+ * e.g. to share it between the shards of a QUIC group.
+ */
+int picoquic_set_ticket_encryption_key(picoquic_quic_t* quic, const uint8_t* ticket_key, size_t ticket_key_length)
+{
+    if (quic->aead_encrypt_ticket_ctx != NULL) {
+        picoquic_aead_free(quic->aead_encrypt_ticket_ctx);
+        quic->aead_encrypt_ticket_ctx = NULL;
+    }
+    if (quic->aead_decrypt_ticket_ctx != NULL) {
+        picoquic_aead_free(quic->aead_decrypt_ticket_ctx);
+        quic->aead_decrypt_ticket_ctx = NULL;
+    }
+
+    return picoquic_server_setup_ticket_aead_contexts(quic, (ptls_context_t*)quic->tls_master_ctx,
+        ticket_key, ticket_key_length);
+}
+
 /* Access integrity limit for AEAD */
 uint64_t picoquic_aead_integrity_limit(void* aead_ctx)
 {
@@ -2441,6 +2886,75 @@ size_t picoquic_aead_encrypt_mp(uint8_t* output, const uint8_t* input, size_t in
     return encrypted;
 }
 
+void picoquic_aead_seal_batch(void* aead_context, void* pn_enc, int is_multipath,
+    picoquic_protect_batch_item_t* items, size_t nb_items)
+{
+    ptls_aead_context_t* aead = (ptls_aead_context_t*)aead_context;
+    size_t tag_size = aead->algo->tag_size;
+
+    for (size_t i = 0; i < nb_items; i++) {
+        picoquic_protect_batch_item_t* item = &items[i];
+        ptls_aead_supplementary_encryption_t supp;
+        uint8_t seq32[4];
+
+        /* The header protection sample starts 4 bytes after the packet number */
+        supp.ctx = (ptls_cipher_context_t*)pn_enc;
+        supp.input = item->packet + item->pn_offset + 4;
+        if (is_multipath) {
+            picoformat_32(seq32, (uint32_t)item->path_id);
+            ptls_aead_xor_iv(aead, seq32, sizeof(seq32));
+        }
+        ptls_aead_encrypt_s(aead, item->packet + item->header_length, item->payload, item->payload_length,
+            item->sequence_number, item->packet, item->header_length, &supp);
+        if (is_multipath) {
+            ptls_aead_xor_iv(aead, seq32, sizeof(seq32));
+        }
+        item->packet_length = item->header_length + item->payload_length + tag_size;
+        memcpy(item->mask, supp.output, sizeof(item->mask));
+    }
+}
+
+void picoquic_aead_open_batch(void* aead_context, int is_multipath,
+    picoquic_protect_batch_item_t* items, size_t nb_items)
+{
+    for (size_t i = 0; i < nb_items; i++) {
+        picoquic_protect_batch_item_t* item = &items[i];
+
+        if (is_multipath) {
+            item->decrypted_length = picoquic_aead_decrypt_mp(item->decrypted, item->payload, item->payload_length,
+                item->path_id, item->sequence_number, item->packet, item->header_length, aead_context);
+        }
+        else {
+            item->decrypted_length = picoquic_aead_decrypt_generic(item->decrypted, item->payload, item->payload_length,
+                item->sequence_number, item->packet, item->header_length, aead_context);
+        }
+    }
+}
+
+/* Compute the header protection masks of a batch of received packets. The
+ * masks are written as consecutive 16 bytes blocks. If the ECB form of the
+ * header protection context is available, all the samples are encrypted in
+ * a single call; otherwise, the masks are computed one by one.
+ */
+void picoquic_pn_mask_batch(void* pn_ctx, void* pn_ecb, const uint8_t** samples, uint8_t* masks, size_t nb_samples)
+{
+    if (pn_ecb != NULL) {
+        for (size_t i = 0; i < nb_samples; i++) {
+            memcpy(masks + 16 * i, samples[i], 16);
+        }
+        ptls_cipher_encrypt((ptls_cipher_context_t*)pn_ecb, masks, masks, 16 * nb_samples);
+    }
+    else {
+        ptls_cipher_context_t* cipher = (ptls_cipher_context_t*)pn_ctx;
+
+        for (size_t i = 0; i < nb_samples; i++) {
+            memset(masks + 16 * i, 0, 16);
+            ptls_cipher_init(cipher, samples[i]);
+            ptls_cipher_encrypt(cipher, masks + 16 * i, masks + 16 * i, 16);
+        }
+    }
+}
+
 /* management of version specific salt, for initial packet encryption.
  */
 
@@ -2461,6 +2975,122 @@ static void picoquic_setup_cleartext_aead_salt(size_t version_index, ptls_iovec_
     }
 }
 
+/* Apply the state transitions that follow the processing of TLS stream data,
+ * and map the TLS return code to a connection error if processing failed.
+ */
+static int picoquic_tls_stream_result(picoquic_cnx_t* cnx, picoquic_tls_ctx_t* ctx, int ret, int data_pushed, uint64_t current_time)
+{
+    if (ret == 0) {
+        switch (cnx->cnx_state) {
+        case picoquic_state_client_retry_received:
+            /* This is not supposed to happen -- HRR should generate "error in progress" */
+            break;
+        case picoquic_state_client_init:
+        case picoquic_state_client_init_sent:
+        case picoquic_state_client_renegotiate:
+        case picoquic_state_client_init_resent:
+        case picoquic_state_client_handshake_start:
+            if (ptls_handshake_is_complete(ctx->tls)) {
+                if (cnx->remote_parameters_received == 0) {
+
+#ifdef _DEBUG
+                    DBG_PRINTF("%s", "Connection error - no transport parameter received.\n");
+#endif
+                    ret = picoquic_connection_error(cnx,
+                        PICOQUIC_TRANSPORT_PARAMETER_ERROR, 0);
+                }
+                else {
+                    if (cnx->crypto_context[3].aead_encrypt != NULL) {
+                        picoquic_client_almost_ready_transition(cnx);
+                    }
+                }
+            }
+            break;
+        case picoquic_state_server_init:
+        case picoquic_state_server_handshake:
+            /* If client authentication is activated, the client sends the certificates with its `Finished` packet.
+               The server does not send any further packets, so, we can switch into false start state here.
+            */
+            if (data_pushed == 0 && ((ptls_context_t*)cnx->quic->tls_master_ctx)->require_client_authentication == 1) {
+                picoquic_false_start_transition(cnx, current_time);
+            }
+            else {
+                if (cnx->crypto_context[3].aead_encrypt != NULL) {
+                    cnx->cnx_state = picoquic_state_server_almost_ready;
+                }
+            }
+            break;
+        case picoquic_state_client_almost_ready:
+        case picoquic_state_handshake_failure:
+        case picoquic_state_handshake_failure_resend:
+        case picoquic_state_client_ready_start:
+        case picoquic_state_server_almost_ready:
+        case picoquic_state_server_false_start:
+        case picoquic_state_ready:
+        case picoquic_state_disconnecting:
+        case picoquic_state_closing_received:
+        case picoquic_state_closing:
+        case picoquic_state_draining:
+        case picoquic_state_disconnected:
+            break;
+        default:
+            DBG_PRINTF("Unexpected connection state: %d\n", cnx->cnx_state);
+            break;
+        }
+    }
+    else if (ret == PTLS_ERROR_IN_PROGRESS && (cnx->cnx_state == picoquic_state_client_init || cnx->cnx_state == picoquic_state_client_init_sent || cnx->cnx_state == picoquic_state_client_init_resent)) {
+        /* Extract and install the client 0-RTT key */
+#ifdef _DEBUG
+        DBG_PRINTF("%s", "Handshake not yet complete.\n");
+#endif
+    }
+    else if (ret == PTLS_ERROR_IN_PROGRESS &&
+        (cnx->cnx_state == picoquic_state_server_init ||
+            cnx->cnx_state == picoquic_state_server_handshake))
+    {
+        if (ptls_handshake_is_complete(ctx->tls))
+        {
+            cnx->cnx_state = picoquic_state_server_almost_ready;
+        }
+    }
+
+    if ((ret == 0 || ret == PTLS_ERROR_IN_PROGRESS || ret == PTLS_ERROR_STATELESS_RETRY ||
+        ret == PTLS_ERROR_ASYNC_OPERATION)) {
+        /* An asynchronous operation parks the handshake, without state transition */
+        ret = 0;
+    }
+    else {
+        uint16_t error_code = PICOQUIC_TRANSPORT_INTERNAL_ERROR;
+
+        if (PTLS_ERROR_GET_CLASS(ret) == PTLS_ERROR_CLASS_SELF_ALERT) {
+            error_code = PICOQUIC_TRANSPORT_CRYPTO_ERROR(ret);
+        }
+#ifdef _DEBUG
+        DBG_PRINTF("Handshake failed, ret = 0x%x.\n", ret);
+#endif
+        (void)picoquic_connection_error(cnx, error_code, 0);
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/* Queue the TLS output produced by ptls_handle_message() on the crypto streams */
+static int picoquic_tls_stream_push(picoquic_cnx_t* cnx, struct st_ptls_buffer_t* sendbuf, size_t* send_offset, int* data_pushed)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < PICOQUIC_NUMBER_OF_EPOCHS; i++) {
+        if (send_offset[i] < send_offset[i + 1]) {
+            *data_pushed = 1;
+            ret = picoquic_add_to_tls_stream(cnx,
+                sendbuf->base + send_offset[i], send_offset[i + 1] - send_offset[i], i);
+        }
+    }
+
+    return ret;
+}
+
 /* Input stream zero data to TLS context.
  *
  * Processing  depends on the "epoch" in which packets have been received. That
@@ -2475,10 +3105,15 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx, int * data_consumed, uint64
     picoquic_tls_ctx_t* ctx = (picoquic_tls_ctx_t*)cnx->tls_ctx;
     size_t next_epoch = 0;
 
+    if (cnx->is_handshake_parked) {
+        /* Data stays queued until the asynchronous operation completes */
+        return 0;
+    }
+
     /* Provide indication of current connection for later callbacks */
     cnx->quic->cnx_in_progress = cnx;
 
-    for (size_t epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS && ret == 0; epoch++) {
+    for (size_t epoch = 0; epoch < PICOQUIC_NUMBER_OF_EPOCHS && ret == 0 && !cnx->is_handshake_parked; epoch++) {
         picoquic_stream_head_t* stream = &cnx->tls_stream[epoch];
         picoquic_stream_data_node_t* data = (picoquic_stream_data_node_t*)picosplay_first(&stream->stream_data_tree);
         size_t processed = 0;
@@ -2523,7 +3158,15 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx, int * data_consumed, uint64
             ret = ptls_handle_message(ctx->tls, &sendbuf, send_offset, epoch,
                 data->bytes + start, epoch_data, &ctx->handshake_properties);
 
-            if ((ret == 0 || ret == PTLS_ERROR_IN_PROGRESS ||
+            if (ret == PTLS_ERROR_ASYNC_OPERATION) {
+                /* The input is consumed, the handshake resumes when the job completes */
+                ret = picoquic_tls_stream_push(cnx, &sendbuf, send_offset, &data_pushed);
+                picoquic_park_handshake(cnx, ctx->tls, epoch);
+                if (ret == 0) {
+                    ret = PTLS_ERROR_ASYNC_OPERATION;
+                }
+            }
+            else if ((ret == 0 || ret == PTLS_ERROR_IN_PROGRESS ||
                 ret == PTLS_ERROR_STATELESS_RETRY)) {
                 for (int i = 0; i < PICOQUIC_NUMBER_OF_EPOCHS; i++) {
                     if (send_offset[i] < send_offset[i + 1]) {
@@ -2577,101 +3220,59 @@ int picoquic_tls_stream_process(picoquic_cnx_t* cnx, int * data_consumed, uint64
         }
 
         if (processed > 0) {
-            if (ret == 0) {
-                switch (cnx->cnx_state) {
-                case picoquic_state_client_retry_received:
-                    /* This is not supposed to happen -- HRR should generate "error in progress" */
-                    break;
-                case picoquic_state_client_init:
-                case picoquic_state_client_init_sent:
-                case picoquic_state_client_renegotiate:
-                case picoquic_state_client_init_resent:
-                case picoquic_state_client_handshake_start:
-                    if (ptls_handshake_is_complete(ctx->tls)) {
-                        if (cnx->remote_parameters_received == 0) {
+            ret = picoquic_tls_stream_result(cnx, ctx, ret, data_pushed, current_time);
+        }
+    }
 
-#ifdef _DEBUG
-                            DBG_PRINTF("%s", "Connection error - no transport parameter received.\n");
-#endif
-                            ret = picoquic_connection_error(cnx,
-                                PICOQUIC_TRANSPORT_PARAMETER_ERROR, 0);
-                        }
-                        else {
-                            if (cnx->crypto_context[3].aead_encrypt != NULL) {
-                                picoquic_client_almost_ready_transition(cnx);
-                            }
-                        }
-                    }
-                    break;
-                case picoquic_state_server_init:
-                case picoquic_state_server_handshake:
-                    /* If client authentication is activated, the client sends the certificates with its `Finished` packet.
-                       The server does not send any further packets, so, we can switch into false start state here.
-                    */
-                    if (data_pushed == 0 && ((ptls_context_t*)cnx->quic->tls_master_ctx)->require_client_authentication == 1) {
-                        picoquic_false_start_transition(cnx, current_time);
-                    }
-                    else {
-                        if (cnx->crypto_context[3].aead_encrypt != NULL) {
-                            cnx->cnx_state = picoquic_state_server_almost_ready;
-                        }
-                    }
-                    break;
-                case picoquic_state_client_almost_ready:
-                case picoquic_state_handshake_failure:
-                case picoquic_state_handshake_failure_resend:
-                case picoquic_state_client_ready_start:
-                case picoquic_state_server_almost_ready:
-                case picoquic_state_server_false_start:
-                case picoquic_state_ready:
-                case picoquic_state_disconnecting:
-                case picoquic_state_closing_received:
-                case picoquic_state_closing:
-                case picoquic_state_draining:
-                case picoquic_state_disconnected:
-                    break;
-                default:
-                    DBG_PRINTF("Unexpected connection state: %d\n", cnx->cnx_state);
-                    break;
-                }
-            }
-            else if (ret == PTLS_ERROR_IN_PROGRESS && (cnx->cnx_state == picoquic_state_client_init || cnx->cnx_state == picoquic_state_client_init_sent || cnx->cnx_state == picoquic_state_client_init_resent)) {
-                /* Extract and install the client 0-RTT key */
-#ifdef _DEBUG
-                DBG_PRINTF("%s", "Handshake not yet complete.\n");
-#endif
-            }
-            else if (ret == PTLS_ERROR_IN_PROGRESS &&
-                (cnx->cnx_state == picoquic_state_server_init ||
-                    cnx->cnx_state == picoquic_state_server_handshake))
-            {
-                if (ptls_handshake_is_complete(ctx->tls))
-                {
-                    cnx->cnx_state = picoquic_state_server_almost_ready;
-                }
-            }
+    /* Reset indication of current connection */
+    cnx->quic->cnx_in_progress = NULL;
 
-            if ((ret == 0 || ret == PTLS_ERROR_IN_PROGRESS || ret == PTLS_ERROR_STATELESS_RETRY)) {
-                ret = 0;
-            }
-            else {
-                uint16_t error_code = PICOQUIC_TRANSPORT_INTERNAL_ERROR;
+    return ret;
+}
 
-                if (PTLS_ERROR_GET_CLASS(ret) == PTLS_ERROR_CLASS_SELF_ALERT) {
-                    error_code = PICOQUIC_TRANSPORT_CRYPTO_ERROR(ret);
-                }
-#ifdef _DEBUG
-                DBG_PRINTF("Handshake failed, ret = 0x%x.\n", ret);
-#endif
-                (void)picoquic_connection_error(cnx, error_code, 0);
-                ret = 0;
-            }
+/*
+ * Resume a handshake parked on an asynchronous operation. The TLS stack is
+ * called again without input, at the epoch at which it was suspended. Data
+ * received while the handshake was parked is then processed.
+ */
+int picoquic_tls_stream_resume(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_tls_ctx_t* ctx = (picoquic_tls_ctx_t*)cnx->tls_ctx;
+    size_t epoch = cnx->parked_epoch;
+    struct st_ptls_buffer_t sendbuf;
+    size_t send_offset[PICOQUIC_NUMBER_OF_EPOCH_OFFSETS] = { 0, 0, 0, 0, 0 };
+    int data_pushed = 0;
+
+    picoquic_unpark_handshake(cnx);
+    cnx->quic->cnx_in_progress = cnx;
+    ptls_buffer_init(&sendbuf, "", 0);
+    picoquic_clear_crypto_errors();
+
+    ret = ptls_handle_message(ctx->tls, &sendbuf, send_offset, epoch, NULL, 0, &ctx->handshake_properties);
+
+    if (ret == 0 || ret == PTLS_ERROR_IN_PROGRESS || ret == PTLS_ERROR_ASYNC_OPERATION) {
+        int push_ret = picoquic_tls_stream_push(cnx, &sendbuf, send_offset, &data_pushed);
+
+        if (ret == PTLS_ERROR_ASYNC_OPERATION) {
+            picoquic_park_handshake(cnx, ctx->tls, epoch);
+        }
+        if (push_ret != 0) {
+            ret = push_ret;
         }
     }
+    else {
+        picoquic_log_crypto_errors(cnx, ret);
+    }
+    ptls_buffer_dispose(&sendbuf);
 
-    /* Reset indication of current connection */
+    ret = picoquic_tls_stream_result(cnx, ctx, ret, data_pushed, current_time);
     cnx->quic->cnx_in_progress = NULL;
 
+    if (ret == 0 && !cnx->is_handshake_parked) {
+        ret = picoquic_tls_stream_process(cnx, NULL, current_time);
+    }
+
     return ret;
 }
 
@@ -2727,6 +3328,7 @@ void picoquic_set_tls_certificate_chain(picoquic_quic_t* quic, ptls_iovec_t* cer
 
     ctx->certificates.list = certs;
     ctx->certificates.count = count;
+    picoquic_certificate_compression_reset(quic);
 }
 
 void picoquic_tls_set_client_authentication(picoquic_quic_t* quic, int client_authentication) {
@@ -2782,7 +3384,7 @@ static int picoquic_server_encrypt_retry_token(picoquic_quic_t * quic, const str
             auth_data = (uint8_t*)&((struct sockaddr_in6*)addr_peer)->sin6_addr;
             auth_data_length = 16;
         }
-        picoquic_crypto_random(quic, token, 8);
+        picoquic_buffered_random(quic, token, 8);
         if (is_new_token) {
             token[0] |= 0x80;
         }
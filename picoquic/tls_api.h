@@ -47,6 +47,8 @@ extern "C" {
 
 int picoquic_master_tlscontext(picoquic_quic_t* quic, char const* cert_file_name, char const* key_file_name,
     char const * cert_root_file_name, const uint8_t* ticket_key, size_t ticket_key_length);
+int picoquic_set_ticket_encryption_key(picoquic_quic_t* quic, const uint8_t* ticket_key, size_t ticket_key_length);
+int picoquic_create_ticket_key_contexts(const uint8_t* key, size_t key_length, void** aead_encrypt, void** aead_decrypt);
 
 void picoquic_master_tlscontext_free(picoquic_quic_t* quic);
 
@@ -59,6 +61,12 @@ void picoquic_tlscontext_trim_after_handshake(picoquic_cnx_t* cnx);
 void picoquic_tlscontext_remove_ticket(picoquic_cnx_t* cnx);
 
 int picoquic_tls_stream_process(picoquic_cnx_t* cnx, int* data_consumed, uint64_t current_time);
+int picoquic_tls_stream_resume(picoquic_cnx_t* cnx, uint64_t current_time);
+void picoquic_park_handshake(picoquic_cnx_t* cnx, void* tls, size_t epoch);
+void picoquic_unpark_handshake(picoquic_cnx_t* cnx);
+void* picoquic_async_signer_release(void* v_sign_certificate);
+void picoquic_key_share_pool_release(picoquic_quic_t* quic);
+void picoquic_certificate_compression_reset(picoquic_quic_t* quic);
 int picoquic_is_tls_complete(picoquic_cnx_t* cnx);
 
 int picoquic_initialize_tls_stream(picoquic_cnx_t* cnx, uint64_t current_time);
@@ -68,6 +76,12 @@ uint64_t picoquic_get_tls_time(picoquic_quic_t* quic);
 void picoquic_crypto_random(picoquic_quic_t* quic, void* buf, size_t len);
 uint64_t picoquic_crypto_uniform_random(picoquic_quic_t* quic, uint64_t rnd_max);
 
+void picoquic_buffered_random(picoquic_quic_t* quic, void* buf, size_t len);
+uint64_t picoquic_buffered_random_64(picoquic_quic_t* quic);
+uint64_t picoquic_buffered_uniform_random(picoquic_quic_t* quic, uint64_t rnd_max);
+void picoquic_buffered_random_clear(picoquic_quic_t* quic);
+void picoquic_chacha20_block(const uint32_t key[8], uint32_t counter, const uint32_t nonce[3], uint8_t out[64]);
+
 uint64_t picoquic_public_random_64(void);
 void picoquic_public_random_seed_64(uint64_t seed, int reset);
 void picoquic_public_random_seed(picoquic_quic_t* quic);
@@ -96,6 +110,33 @@ size_t picoquic_pn_iv_size(void *pn_enc);
 
 void picoquic_pn_encrypt(void *pn_enc, const void * iv, void *output, const void *input, size_t len);
 
+/* Batch protection of packets that use the same keys, such as the packets of
+ * a GSO train. The sealing of each packet encrypts the payload and computes the
+ * header protection mask in a single call, which lets providers that support it,
+ * such as fusion, run the AES pipeline once per packet instead of twice.
+ * The header protection mask is returned in the item, and applied by the
+ * caller after logging the unprotected header.
+ */
+typedef struct st_picoquic_protect_batch_item_t {
+    uint8_t* packet; /* header, then protected payload */
+    size_t header_length; /* unprotected header, used as authenticated data */
+    size_t pn_offset; /* offset of the 4 bytes packet number in the header */
+    const uint8_t* payload; /* clear text, or cipher text when opening */
+    size_t payload_length;
+    uint64_t sequence_number;
+    uint64_t path_id; /* Used to compute the nonce if multipath is set */
+    uint8_t* decrypted; /* Open only: where the clear text is written */
+    size_t packet_length; /* Set by seal: total length after protection */
+    size_t decrypted_length; /* Set by open: SIZE_MAX if authentication fails */
+    uint8_t mask[16]; /* header protection mask */
+} picoquic_protect_batch_item_t;
+
+void picoquic_aead_seal_batch(void* aead_context, void* pn_enc, int is_multipath,
+    picoquic_protect_batch_item_t* items, size_t nb_items);
+void picoquic_aead_open_batch(void* aead_context, int is_multipath,
+    picoquic_protect_batch_item_t* items, size_t nb_items);
+void picoquic_pn_mask_batch(void* pn_ctx, void* pn_ecb, const uint8_t** samples, uint8_t* masks, size_t nb_samples);
+
 typedef const struct st_ptls_cipher_suite_t ptls_cipher_suite_t;
 
 int picoquic_setup_initial_master_secret(
@@ -111,17 +152,27 @@ int picoquic_setup_initial_secrets(
     uint8_t * server_secret);
 
 int picoquic_setup_initial_traffic_keys(picoquic_cnx_t* cnx);
+picoquic_crypto_context_t* picoquic_initial_key_cache_get(picoquic_quic_t* quic, int version_index,
+    picoquic_connection_id_t* initial_cnxid);
+void picoquic_initial_key_cache_free(picoquic_quic_t* quic);
 
 int picoquic_get_initial_aead_context(picoquic_quic_t* quic, int version_index, picoquic_connection_id_t* initial_cnxid,
     int is_client, int is_enc, void** aead_ctx, void** pn_enc_ctx);
 
 uint8_t * picoquic_get_app_secret(picoquic_cnx_t* cnx, int is_enc);
 size_t picoquic_get_app_secret_size(picoquic_cnx_t* cnx);
+int picoquic_get_app_cipher_suite_id(picoquic_cnx_t* cnx);
+int picoquic_import_app_traffic_secrets(picoquic_cnx_t* cnx, int cipher_suite_id,
+    const uint8_t* secret_enc, const uint8_t* secret_dec, size_t secret_length);
 int picoquic_compute_new_rotated_keys(picoquic_cnx_t * cnx);
 void picoquic_apply_rotated_keys(picoquic_cnx_t * cnx, int is_enc);
+void picoquic_precompute_rotated_keys(picoquic_cnx_t* cnx);
 int picoquic_rotate_app_secret(ptls_cipher_suite_t * cipher, uint8_t * secret, const char *traffic_update_label);
 
 void picoquic_crypto_context_free(picoquic_crypto_context_t * ctx);
+int picoquic_set_crypto_context_from_secret(picoquic_crypto_context_t* ctx, int cipher_suite_id, int version_index,
+    int is_enc, int is_rotation, const uint8_t* secret, size_t secret_length);
+int picoquic_rotate_secret_by_id(int cipher_suite_id, int version_index, uint8_t* secret, size_t secret_length);
 
 void * picoquic_setup_test_aead_context(int is_encrypt, const uint8_t * secret, const char *prefix_label);
 void * picoquic_pn_enc_create_for_test(const uint8_t * secret, const char *prefix_label);
@@ -0,0 +1,434 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Asynchronous signature of the server certificate verify.
+*
+* The signer wraps the "sign_certificate" object of the TLS master context.
+* When picotls asks for a signature on the server side, the request is queued
+* to a pool of worker threads and the callback returns PTLS_ERROR_ASYNC_OPERATION.
+* The handshake of the connection is then parked (see picoquic_tls_stream_process).
+* When the worker completes, it marks the connection as ready and calls the
+* wake up function of the quic context, so that the network thread resumes
+* the handshake in picoquic_process_async_handshakes.
+*
+* Jobs belong to the TLS context of the connection. If the connection is deleted
+* while the job is running, the job is marked abandoned and freed by the worker.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picotls.h"
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "tls_api.h"
+
+#define PICOQUIC_ASYNC_SIGNER_THREADS_MAX 64
+#define PICOQUIC_ASYNC_SIGNER_WAIT_USEC 100000
+
+typedef enum {
+    picoquic_async_job_queued = 0,
+    picoquic_async_job_running,
+    picoquic_async_job_done
+} picoquic_async_job_state_enum;
+
+typedef struct st_picoquic_async_signer_t picoquic_async_signer_t;
+
+typedef struct st_picoquic_async_sign_job_t {
+    ptls_async_job_t super;
+    picoquic_async_signer_t* signer;
+    struct st_picoquic_async_sign_job_t* next_job;
+    picoquic_async_job_state_enum state;
+    int is_abandoned;
+    uint8_t* input;
+    size_t input_length;
+    uint16_t* algorithms;
+    size_t num_algorithms;
+    uint16_t selected_algorithm;
+    int sign_ret;
+    ptls_buffer_t output;
+    void (*completion_cb)(void*);
+    void* completion_cbdata;
+} picoquic_async_sign_job_t;
+
+struct st_picoquic_async_signer_t {
+    ptls_sign_certificate_t super;
+    ptls_sign_certificate_t* inner;
+    picoquic_quic_t* quic;
+    picoquic_mutex_t mutex;
+    picoquic_event_t event;
+    picoquic_async_sign_job_t* first_job;
+    picoquic_async_sign_job_t* last_job;
+    picoquic_thread_t threads[PICOQUIC_ASYNC_SIGNER_THREADS_MAX];
+    int nb_threads;
+    volatile int should_close;
+};
+
+static void picoquic_async_job_free(picoquic_async_sign_job_t* job)
+{
+    ptls_buffer_dispose(&job->output);
+    if (job->input != NULL) {
+        free(job->input);
+    }
+    if (job->algorithms != NULL) {
+        free(job->algorithms);
+    }
+    free(job);
+}
+
+/* Called by picotls, or by the signer, on the network thread */
+static void picoquic_async_job_destroy(ptls_async_job_t* async_job)
+{
+    picoquic_async_sign_job_t* job = (picoquic_async_sign_job_t*)async_job;
+    picoquic_async_signer_t* signer = job->signer;
+    int is_free = 1;
+
+    picoquic_lock_mutex(&signer->mutex);
+    if (job->state == picoquic_async_job_running) {
+        /* The worker thread will free the job when done */
+        job->is_abandoned = 1;
+        is_free = 0;
+    }
+    else if (job->state == picoquic_async_job_queued) {
+        picoquic_async_sign_job_t** pprevious = &signer->first_job;
+
+        while (*pprevious != NULL && *pprevious != job) {
+            pprevious = &(*pprevious)->next_job;
+        }
+        if (*pprevious != NULL) {
+            *pprevious = job->next_job;
+            if (signer->last_job == job) {
+                signer->last_job = NULL;
+                for (picoquic_async_sign_job_t* j = signer->first_job; j != NULL; j = j->next_job) {
+                    signer->last_job = j;
+                }
+            }
+        }
+    }
+    picoquic_unlock_mutex(&signer->mutex);
+
+    if (is_free) {
+        picoquic_async_job_free(job);
+    }
+}
+
+static void picoquic_async_job_set_completion_callback(ptls_async_job_t* async_job, void (*cb)(void*), void* cbdata)
+{
+    picoquic_async_sign_job_t* job = (picoquic_async_sign_job_t*)async_job;
+    int is_done;
+
+    picoquic_lock_mutex(&job->signer->mutex);
+    job->completion_cb = cb;
+    job->completion_cbdata = cbdata;
+    is_done = (job->state == picoquic_async_job_done);
+    picoquic_unlock_mutex(&job->signer->mutex);
+
+    if (is_done && cb != NULL) {
+        cb(cbdata);
+    }
+}
+
+static picoquic_thread_return_t picoquic_async_signer_thread(void* v_signer)
+{
+    picoquic_async_signer_t* signer = (picoquic_async_signer_t*)v_signer;
+
+    while (!signer->should_close) {
+        picoquic_async_sign_job_t* job = NULL;
+
+        picoquic_lock_mutex(&signer->mutex);
+        if ((job = signer->first_job) != NULL) {
+            signer->first_job = job->next_job;
+            if (signer->first_job == NULL) {
+                signer->last_job = NULL;
+            }
+            job->next_job = NULL;
+            job->state = picoquic_async_job_running;
+        }
+        picoquic_unlock_mutex(&signer->mutex);
+
+        if (job == NULL) {
+            (void)picoquic_wait_for_event(&signer->event, PICOQUIC_ASYNC_SIGNER_WAIT_USEC);
+        }
+        else {
+            /* The TLS context is not passed to the inner signer, because the
+             * connection may be deleted while the signature is computed. */
+            job->sign_ret = signer->inner->cb(signer->inner, NULL, NULL, &job->selected_algorithm, &job->output,
+                ptls_iovec_init(job->input, job->input_length), job->algorithms, job->num_algorithms);
+
+            picoquic_lock_mutex(&signer->mutex);
+            job->state = picoquic_async_job_done;
+            if (job->is_abandoned) {
+                picoquic_async_job_free(job);
+            }
+            else if (job->completion_cb != NULL) {
+                job->completion_cb(job->completion_cbdata);
+            }
+            picoquic_unlock_mutex(&signer->mutex);
+        }
+    }
+
+    picoquic_thread_do_return;
+}
+
+static picoquic_async_sign_job_t* picoquic_async_job_create(picoquic_async_signer_t* signer,
+    ptls_iovec_t input, const uint16_t* algorithms, size_t num_algorithms)
+{
+    picoquic_async_sign_job_t* job = (picoquic_async_sign_job_t*)malloc(sizeof(picoquic_async_sign_job_t));
+
+    if (job != NULL) {
+        memset(job, 0, sizeof(picoquic_async_sign_job_t));
+        job->super.destroy_ = picoquic_async_job_destroy;
+        job->super.set_completion_callback = picoquic_async_job_set_completion_callback;
+        job->signer = signer;
+        ptls_buffer_init(&job->output, "", 0);
+        job->input = (uint8_t*)malloc(input.len);
+        job->algorithms = (uint16_t*)malloc(num_algorithms * sizeof(uint16_t));
+        if (job->input == NULL || (num_algorithms > 0 && job->algorithms == NULL)) {
+            picoquic_async_job_free(job);
+            job = NULL;
+        }
+        else {
+            memcpy(job->input, input.base, input.len);
+            job->input_length = input.len;
+            memcpy(job->algorithms, algorithms, num_algorithms * sizeof(uint16_t));
+            job->num_algorithms = num_algorithms;
+        }
+    }
+
+    return job;
+}
+
+static int picoquic_async_sign_certificate(ptls_sign_certificate_t* self, ptls_t* tls, ptls_async_job_t** async,
+    uint16_t* selected_algorithm, ptls_buffer_t* output, ptls_iovec_t input, const uint16_t* algorithms, size_t num_algorithms)
+{
+    picoquic_async_signer_t* signer = (picoquic_async_signer_t*)self;
+    int ret = 0;
+
+    if (async == NULL) {
+        /* Asynchronous operation is only supported on the server side */
+        ret = signer->inner->cb(signer->inner, tls, NULL, selected_algorithm, output, input, algorithms, num_algorithms);
+    }
+    else if (*async != NULL) {
+        /* Resuming the handshake: deliver the result of the job */
+        picoquic_async_sign_job_t* job = (picoquic_async_sign_job_t*)*async;
+        int is_done;
+
+        picoquic_lock_mutex(&signer->mutex);
+        is_done = (job->state == picoquic_async_job_done);
+        picoquic_unlock_mutex(&signer->mutex);
+
+        if (!is_done) {
+            ret = PTLS_ERROR_ASYNC_OPERATION;
+        }
+        else {
+            if ((ret = job->sign_ret) == 0) {
+                *selected_algorithm = job->selected_algorithm;
+                if ((ret = ptls_buffer_reserve(output, job->output.off)) == 0) {
+                    memcpy(output->base + output->off, job->output.base, job->output.off);
+                    output->off += job->output.off;
+                }
+            }
+            *async = NULL;
+            picoquic_async_job_destroy(&job->super);
+        }
+    }
+    else {
+        picoquic_async_sign_job_t* job = picoquic_async_job_create(signer, input, algorithms, num_algorithms);
+
+        if (job == NULL) {
+            /* Could not allocate the job, sign synchronously */
+            ret = signer->inner->cb(signer->inner, tls, NULL, selected_algorithm, output, input, algorithms, num_algorithms);
+        }
+        else {
+            picoquic_lock_mutex(&signer->mutex);
+            if (signer->last_job == NULL) {
+                signer->first_job = job;
+            }
+            else {
+                signer->last_job->next_job = job;
+            }
+            signer->last_job = job;
+            picoquic_unlock_mutex(&signer->mutex);
+            (void)picoquic_signal_event(&signer->event);
+
+            *async = &job->super;
+            ret = PTLS_ERROR_ASYNC_OPERATION;
+        }
+    }
+
+    return ret;
+}
+
+static void picoquic_async_signer_stop(picoquic_async_signer_t* signer)
+{
+    signer->should_close = 1;
+    for (int i = 0; i < signer->nb_threads; i++) {
+        (void)picoquic_signal_event(&signer->event);
+    }
+    for (int i = 0; i < signer->nb_threads; i++) {
+        (void)picoquic_wait_thread(signer->threads[i]);
+        picoquic_delete_thread(&signer->threads[i]);
+    }
+    signer->nb_threads = 0;
+}
+
+int picoquic_enable_async_signing(picoquic_quic_t* quic, int nb_threads)
+{
+    int ret = 0;
+    ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+    picoquic_async_signer_t* signer = NULL;
+
+    if (ctx == NULL || ctx->sign_certificate == NULL || nb_threads <= 0 ||
+        ctx->sign_certificate->cb == picoquic_async_sign_certificate) {
+        ret = -1;
+    }
+    else if ((signer = (picoquic_async_signer_t*)malloc(sizeof(picoquic_async_signer_t))) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(signer, 0, sizeof(picoquic_async_signer_t));
+        signer->super.cb = picoquic_async_sign_certificate;
+        signer->inner = ctx->sign_certificate;
+        signer->quic = quic;
+        if (nb_threads > PICOQUIC_ASYNC_SIGNER_THREADS_MAX) {
+            nb_threads = PICOQUIC_ASYNC_SIGNER_THREADS_MAX;
+        }
+
+        if (picoquic_create_mutex(&signer->mutex) != 0) {
+            free(signer);
+            ret = -1;
+        }
+        else if (picoquic_create_event(&signer->event) != 0) {
+            (void)picoquic_delete_mutex(&signer->mutex);
+            free(signer);
+            ret = -1;
+        }
+        else {
+            while (signer->nb_threads < nb_threads &&
+                picoquic_create_thread(&signer->threads[signer->nb_threads], picoquic_async_signer_thread, signer) == 0) {
+                signer->nb_threads++;
+            }
+            if (signer->nb_threads == 0) {
+                picoquic_delete_event(&signer->event);
+                (void)picoquic_delete_mutex(&signer->mutex);
+                free(signer);
+                ret = -1;
+            }
+            else {
+                ctx->sign_certificate = &signer->super;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* If the sign certificate object is an asynchronous signer, stop the worker
+ * threads, free the signer and return the wrapped object. Otherwise, return
+ * the object unchanged. */
+void* picoquic_async_signer_release(void* v_sign_certificate)
+{
+    ptls_sign_certificate_t* sign_certificate = (ptls_sign_certificate_t*)v_sign_certificate;
+
+    if (sign_certificate != NULL && sign_certificate->cb == picoquic_async_sign_certificate) {
+        picoquic_async_signer_t* signer = (picoquic_async_signer_t*)sign_certificate;
+
+        sign_certificate = signer->inner;
+        picoquic_async_signer_stop(signer);
+        /* Jobs still queued belong to TLS contexts, which have all been freed */
+        picoquic_delete_event(&signer->event);
+        (void)picoquic_delete_mutex(&signer->mutex);
+        free(signer);
+    }
+
+    return sign_certificate;
+}
+
+/* Completion of an asynchronous job. This is called from the worker thread. */
+static void picoquic_async_handshake_done(void* v_cnx)
+{
+    picoquic_cnx_t* cnx = (picoquic_cnx_t*)v_cnx;
+
+    cnx->is_async_handshake_ready = 1;
+    if (cnx->quic->async_wake_fn != NULL) {
+        cnx->quic->async_wake_fn(cnx->quic->async_wake_ctx);
+    }
+}
+
+/* Park the handshake of the connection until the asynchronous operation completes */
+void picoquic_park_handshake(picoquic_cnx_t* cnx, void* tls, size_t epoch)
+{
+    ptls_async_job_t* job = ptls_get_async_job((ptls_t*)tls);
+
+    if (!cnx->is_handshake_parked) {
+        cnx->is_handshake_parked = 1;
+        cnx->parked_epoch = epoch;
+        cnx->is_async_handshake_ready = 0;
+        cnx->quic->nb_parked_handshakes++;
+        if (job != NULL && job->set_completion_callback != NULL) {
+            job->set_completion_callback(job, picoquic_async_handshake_done, cnx);
+        }
+        else {
+            /* Without completion callback, the handshake is retried at each call */
+            cnx->is_async_handshake_ready = 1;
+        }
+    }
+}
+
+void picoquic_unpark_handshake(picoquic_cnx_t* cnx)
+{
+    if (cnx->is_handshake_parked) {
+        cnx->is_handshake_parked = 0;
+        cnx->is_async_handshake_ready = 0;
+        if (cnx->quic->nb_parked_handshakes > 0) {
+            cnx->quic->nb_parked_handshakes--;
+        }
+    }
+}
+
+void picoquic_set_async_wake_fn(picoquic_quic_t* quic, picoquic_async_wake_fn wake_fn, void* wake_ctx)
+{
+    quic->async_wake_fn = wake_fn;
+    quic->async_wake_ctx = wake_ctx;
+}
+
+int picoquic_process_async_handshakes(picoquic_quic_t* quic, uint64_t current_time)
+{
+    picoquic_cnx_t* cnx = quic->cnx_list;
+    int nb_resumed = 0;
+
+    while (cnx != NULL && quic->nb_parked_handshakes > 0) {
+        picoquic_cnx_t* next_cnx = cnx->next_in_table;
+
+        if (cnx->is_handshake_parked && cnx->is_async_handshake_ready) {
+            if (picoquic_tls_stream_resume(cnx, current_time) == 0) {
+                nb_resumed++;
+            }
+            picoquic_reinsert_by_wake_time(quic, cnx, current_time);
+        }
+        cnx = next_cnx;
+    }
+
+    return nb_resumed;
+}
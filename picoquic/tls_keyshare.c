@@ -0,0 +1,368 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Pool of pregenerated ephemeral key shares.
+*
+* Generating the ephemeral key share of the TLS key exchange is a large part
+* of the cost of a handshake. The pool wraps each key exchange algorithm of
+* the TLS master context. The wrappers draw contexts that were generated in
+* advance, and a background thread refills the pool so that key generation
+* happens outside of the handshake processing. If the pool is empty, the
+* wrapper falls back to the inner algorithm.
+*
+* Each pooled context is removed from the pool when it is drawn, and is
+* released by picotls after the exchange, so that a key share is never used
+* for more than one handshake.
+*
+* The inner "create" function is called from the refill thread. The crypto
+* providers used by picoquic (openssl, minicrypto, mbedtls) generate keys
+* without shared state beyond their thread safe random generator.
+*/
+
+#ifdef _WINDOWS
+#include "wincompat.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "picotls.h"
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picoquic_crypto_provider_api.h"
+#include "tls_api.h"
+
+#define PICOQUIC_KEY_SHARE_POOL_MIN 4
+#define PICOQUIC_KEY_SHARE_POOL_MAX 1024
+#define PICOQUIC_KEY_SHARE_POOL_REFILL_USEC 100000
+
+typedef struct st_picoquic_key_share_pool_t picoquic_key_share_pool_t;
+
+typedef struct st_picoquic_key_share_algo_t {
+    struct st_ptls_key_exchange_algorithm_t super;
+    ptls_key_exchange_algorithm_t* inner;
+    picoquic_key_share_pool_t* pool;
+    ptls_key_exchange_context_t** ring;
+    size_t ring_first;
+    size_t ring_count;
+} picoquic_key_share_algo_t;
+
+struct st_picoquic_key_share_pool_t {
+    picoquic_key_share_algo_t algos[PICOQUIC_KEY_EXCHANGES_NB_MAX];
+    ptls_key_exchange_algorithm_t* key_exchanges[PICOQUIC_KEY_EXCHANGES_NB_MAX + 1];
+    ptls_key_exchange_algorithm_t** inner_key_exchanges;
+    size_t nb_algos;
+    size_t capacity;
+    picoquic_mutex_t mutex;
+    picoquic_event_t event;
+    picoquic_thread_t thread;
+    int is_thread_started;
+    volatile int should_close;
+    uint64_t nb_drawn;
+    uint64_t nb_missed;
+};
+
+/* Remove the oldest context from the ring, or return NULL if empty.
+ * Must be called with the pool mutex held. */
+static ptls_key_exchange_context_t* picoquic_key_share_ring_pop(picoquic_key_share_algo_t* algo)
+{
+    ptls_key_exchange_context_t* keyex = NULL;
+
+    if (algo->ring_count > 0) {
+        keyex = algo->ring[algo->ring_first];
+        algo->ring[algo->ring_first] = NULL;
+        algo->ring_first = (algo->ring_first + 1) % algo->pool->capacity;
+        algo->ring_count--;
+    }
+
+    return keyex;
+}
+
+/* Generate one key share and add it to the ring of the algorithm.
+ * Must be called without the mutex, since key generation is slow.
+ * Returns 0 if a key was added. */
+static int picoquic_key_share_refill_one(picoquic_key_share_algo_t* algo)
+{
+    ptls_key_exchange_context_t* keyex = NULL;
+    int ret = algo->inner->create(algo->inner, &keyex);
+
+    if (ret == 0) {
+        picoquic_lock_mutex(&algo->pool->mutex);
+        if (algo->ring_count < algo->pool->capacity) {
+            algo->ring[(algo->ring_first + algo->ring_count) % algo->pool->capacity] = keyex;
+            algo->ring_count++;
+            keyex = NULL;
+        }
+        else {
+            ret = -1;
+        }
+        picoquic_unlock_mutex(&algo->pool->mutex);
+
+        if (keyex != NULL) {
+            (void)keyex->on_exchange(&keyex, 1, NULL, ptls_iovec_init(NULL, 0));
+        }
+    }
+
+    return ret;
+}
+
+/* Draw a key share from the pool, and wake up the refill thread
+ * when the ring falls below half of its capacity. */
+static ptls_key_exchange_context_t* picoquic_key_share_draw(picoquic_key_share_algo_t* algo)
+{
+    picoquic_key_share_pool_t* pool = algo->pool;
+    ptls_key_exchange_context_t* keyex = NULL;
+    int should_signal = 0;
+
+    picoquic_lock_mutex(&pool->mutex);
+    keyex = picoquic_key_share_ring_pop(algo);
+    if (keyex == NULL) {
+        pool->nb_missed++;
+    }
+    else {
+        pool->nb_drawn++;
+    }
+    should_signal = (algo->ring_count < pool->capacity / 2);
+    picoquic_unlock_mutex(&pool->mutex);
+
+    if (should_signal && pool->is_thread_started) {
+        (void)picoquic_signal_event(&pool->event);
+    }
+
+    return keyex;
+}
+
+/* Client side: the context is sent in the Client Hello and released
+ * by picotls after the exchange, or when the connection is deleted. */
+static int picoquic_key_share_create(const struct st_ptls_key_exchange_algorithm_t* ptls_algo,
+    ptls_key_exchange_context_t** ctx)
+{
+    picoquic_key_share_algo_t* algo = (picoquic_key_share_algo_t*)ptls_algo;
+    int ret = 0;
+
+    if ((*ctx = picoquic_key_share_draw(algo)) == NULL) {
+        ret = algo->inner->create(algo->inner, ctx);
+    }
+
+    return ret;
+}
+
+/* Server side: perform the exchange with a pooled context. Picotls frees
+ * the public key and the secret after use, so the public key is copied
+ * before the context is released by "on_exchange". */
+static int picoquic_key_share_exchange(const struct st_ptls_key_exchange_algorithm_t* ptls_algo,
+    ptls_iovec_t* pubkey, ptls_iovec_t* secret, ptls_iovec_t peerkey)
+{
+    picoquic_key_share_algo_t* algo = (picoquic_key_share_algo_t*)ptls_algo;
+    ptls_key_exchange_context_t* keyex = picoquic_key_share_draw(algo);
+    int ret = 0;
+
+    if (keyex == NULL) {
+        ret = algo->inner->exchange(algo->inner, pubkey, secret, peerkey);
+    }
+    else if ((pubkey->base = (uint8_t*)malloc(keyex->pubkey.len)) == NULL) {
+        (void)keyex->on_exchange(&keyex, 1, NULL, ptls_iovec_init(NULL, 0));
+        ret = PTLS_ERROR_NO_MEMORY;
+    }
+    else {
+        memcpy(pubkey->base, keyex->pubkey.base, keyex->pubkey.len);
+        pubkey->len = keyex->pubkey.len;
+        if ((ret = keyex->on_exchange(&keyex, 1, secret, peerkey)) != 0) {
+            free(pubkey->base);
+            *pubkey = ptls_iovec_init(NULL, 0);
+        }
+    }
+
+    return ret;
+}
+
+/* Fill the rings of all algorithms up to capacity */
+static void picoquic_key_share_refill(picoquic_key_share_pool_t* pool)
+{
+    for (size_t i = 0; i < pool->nb_algos && !pool->should_close; i++) {
+        picoquic_key_share_algo_t* algo = &pool->algos[i];
+        int is_full = 0;
+
+        while (!is_full && !pool->should_close) {
+            picoquic_lock_mutex(&pool->mutex);
+            is_full = (algo->ring_count >= pool->capacity);
+            picoquic_unlock_mutex(&pool->mutex);
+
+            if (!is_full && picoquic_key_share_refill_one(algo) != 0) {
+                break;
+            }
+        }
+    }
+}
+
+static picoquic_thread_return_t picoquic_key_share_pool_thread(void* v_pool)
+{
+    picoquic_key_share_pool_t* pool = (picoquic_key_share_pool_t*)v_pool;
+
+    while (!pool->should_close) {
+        picoquic_key_share_refill(pool);
+        if (!pool->should_close) {
+            (void)picoquic_wait_for_event(&pool->event, PICOQUIC_KEY_SHARE_POOL_REFILL_USEC);
+        }
+    }
+
+    picoquic_thread_do_return;
+}
+
+static void picoquic_key_share_pool_free(picoquic_key_share_pool_t* pool)
+{
+    if (pool->is_thread_started) {
+        pool->should_close = 1;
+        (void)picoquic_signal_event(&pool->event);
+        (void)picoquic_wait_thread(pool->thread);
+        picoquic_delete_thread(&pool->thread);
+        pool->is_thread_started = 0;
+    }
+
+    for (size_t i = 0; i < pool->nb_algos; i++) {
+        picoquic_key_share_algo_t* algo = &pool->algos[i];
+
+        if (algo->ring != NULL) {
+            ptls_key_exchange_context_t* keyex;
+
+            while ((keyex = picoquic_key_share_ring_pop(algo)) != NULL) {
+                (void)keyex->on_exchange(&keyex, 1, NULL, ptls_iovec_init(NULL, 0));
+            }
+            free(algo->ring);
+            algo->ring = NULL;
+        }
+    }
+
+    picoquic_delete_event(&pool->event);
+    (void)picoquic_delete_mutex(&pool->mutex);
+    free(pool);
+}
+
+/* The pool holds enough key shares per algorithm to absorb the expected
+ * handshake rate during one refill period of the background thread. */
+int picoquic_enable_key_share_pool(picoquic_quic_t* quic, size_t handshakes_per_second)
+{
+    int ret = 0;
+    ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+    picoquic_key_share_pool_t* pool = NULL;
+
+    if (ctx == NULL || ctx->key_exchanges == NULL || ctx->key_exchanges[0] == NULL || quic->key_share_pool != NULL) {
+        ret = -1;
+    }
+    else if ((pool = (picoquic_key_share_pool_t*)malloc(sizeof(picoquic_key_share_pool_t))) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(pool, 0, sizeof(picoquic_key_share_pool_t));
+        pool->capacity = (handshakes_per_second * PICOQUIC_KEY_SHARE_POOL_REFILL_USEC) / 1000000;
+        if (pool->capacity < PICOQUIC_KEY_SHARE_POOL_MIN) {
+            pool->capacity = PICOQUIC_KEY_SHARE_POOL_MIN;
+        }
+        else if (pool->capacity > PICOQUIC_KEY_SHARE_POOL_MAX) {
+            pool->capacity = PICOQUIC_KEY_SHARE_POOL_MAX;
+        }
+
+        if (picoquic_create_mutex(&pool->mutex) != 0) {
+            free(pool);
+            ret = -1;
+        }
+        else if (picoquic_create_event(&pool->event) != 0) {
+            (void)picoquic_delete_mutex(&pool->mutex);
+            free(pool);
+            ret = -1;
+        }
+        else {
+            pool->inner_key_exchanges = ctx->key_exchanges;
+            while (ret == 0 && pool->nb_algos < PICOQUIC_KEY_EXCHANGES_NB_MAX &&
+                ctx->key_exchanges[pool->nb_algos] != NULL) {
+                picoquic_key_share_algo_t* algo = &pool->algos[pool->nb_algos];
+
+                algo->inner = ctx->key_exchanges[pool->nb_algos];
+                algo->super = *algo->inner;
+                algo->super.create = picoquic_key_share_create;
+                algo->super.exchange = picoquic_key_share_exchange;
+                algo->pool = pool;
+                if ((algo->ring = (ptls_key_exchange_context_t**)malloc(
+                    pool->capacity * sizeof(ptls_key_exchange_context_t*))) == NULL) {
+                    ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    memset(algo->ring, 0, pool->capacity * sizeof(ptls_key_exchange_context_t*));
+                    pool->key_exchanges[pool->nb_algos] = &algo->super;
+                    pool->nb_algos++;
+                }
+            }
+
+            if (ret == 0) {
+                /* The initial fill is done synchronously, so the first
+                 * handshakes already find keys in the pool. */
+                picoquic_key_share_refill(pool);
+                if (picoquic_create_thread(&pool->thread, picoquic_key_share_pool_thread, pool) != 0) {
+                    ret = -1;
+                }
+                else {
+                    pool->is_thread_started = 1;
+                }
+            }
+
+            if (ret != 0) {
+                picoquic_key_share_pool_free(pool);
+            }
+            else {
+                ctx->key_exchanges = pool->key_exchanges;
+                quic->key_share_pool = pool;
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_get_key_share_pool_stats(picoquic_quic_t* quic, uint64_t* nb_drawn, uint64_t* nb_missed)
+{
+    picoquic_key_share_pool_t* pool = quic->key_share_pool;
+
+    *nb_drawn = 0;
+    *nb_missed = 0;
+    if (pool != NULL) {
+        picoquic_lock_mutex(&pool->mutex);
+        *nb_drawn = pool->nb_drawn;
+        *nb_missed = pool->nb_missed;
+        picoquic_unlock_mutex(&pool->mutex);
+    }
+}
+
+/* Stop the refill thread, release the pending key shares and restore
+ * the key exchanges of the TLS context, if they were not changed since. */
+void picoquic_key_share_pool_release(picoquic_quic_t* quic)
+{
+    picoquic_key_share_pool_t* pool = quic->key_share_pool;
+
+    if (pool != NULL) {
+        ptls_context_t* ctx = (ptls_context_t*)quic->tls_master_ctx;
+
+        if (ctx != NULL && ctx->key_exchanges == pool->key_exchanges) {
+            ctx->key_exchanges = pool->inner_key_exchanges;
+        }
+        picoquic_key_share_pool_free(pool);
+        quic->key_share_pool = NULL;
+    }
+}
@@ -154,13 +154,215 @@ int picoquic_deserialize_token(picoquic_stored_token_t ** token, uint8_t * bytes
     return ret;
 }
 
+/* Hash index of the stored tokens.
+ * The bins chain the tokens sharing the same SNI hash, in the same relative
+ * order as the main list. The SNI alone is used as key, because tokens can be
+ * requested without specifying the IP address. If the bins cannot be
+ * allocated, lookups fall back to scanning the list.
+ */
+static uint64_t picoquic_stored_token_hash(picoquic_quic_t* quic, char const* sni, uint16_t sni_length)
+{
+    return picohash_siphash((const uint8_t*)sni, sni_length, quic->hash_seed);
+}
+
+static void picoquic_stored_token_bin_insert(picoquic_stored_token_index_t* index, picoquic_stored_token_t* stored)
+{
+    if (index->bins != NULL) {
+        picoquic_stored_token_t** bin = &index->bins[stored->index_hash & (index->nb_bins - 1)];
+        stored->next_in_bin = *bin;
+        *bin = stored;
+    }
+}
+
+static void picoquic_stored_token_bin_remove(picoquic_stored_token_index_t* index, picoquic_stored_token_t* stored)
+{
+    if (index->bins != NULL) {
+        picoquic_stored_token_t** pprevious = &index->bins[stored->index_hash & (index->nb_bins - 1)];
+
+        while (*pprevious != NULL) {
+            if (*pprevious == stored) {
+                *pprevious = stored->next_in_bin;
+                break;
+            }
+            pprevious = &(*pprevious)->next_in_bin;
+        }
+    }
+    stored->next_in_bin = NULL;
+}
+
+static void picoquic_stored_token_index_rebuild(picoquic_quic_t* quic)
+{
+    picoquic_stored_token_index_t* index = &quic->token_index;
+    picoquic_stored_token_t* previous = NULL;
+    picoquic_stored_token_t* next = quic->p_first_token;
+    size_t nb_tokens = 0;
+    size_t nb_bins = PICOQUIC_STORED_INDEX_MIN_BINS;
+
+    /* Restore the back links, which are not maintained by code handling the list directly */
+    while (next != NULL) {
+        next->previous_token = previous;
+        next->index_hash = picoquic_stored_token_hash(quic, next->sni, next->sni_length);
+        next->next_in_bin = NULL;
+        previous = next;
+        next = next->next_token;
+        nb_tokens++;
+    }
+    index->last_token = previous;
+    index->nb_tokens = nb_tokens;
+    index->indexed_first = quic->p_first_token;
+
+    while (nb_bins < nb_tokens) {
+        nb_bins *= 2;
+    }
+    if (index->bins == NULL || index->nb_bins != nb_bins) {
+        if (index->bins != NULL) {
+            free(index->bins);
+        }
+        index->bins = (picoquic_stored_token_t**)malloc(nb_bins * sizeof(picoquic_stored_token_t*));
+        index->nb_bins = (index->bins == NULL) ? 0 : nb_bins;
+    }
+    if (index->bins != NULL) {
+        memset(index->bins, 0, index->nb_bins * sizeof(picoquic_stored_token_t*));
+        /* Insert from the tail, so each bin follows the order of the list */
+        next = index->last_token;
+        while (next != NULL) {
+            picoquic_stored_token_bin_insert(index, next);
+            next = next->previous_token;
+        }
+    }
+}
+
+static picoquic_stored_token_index_t* picoquic_stored_token_index_check(picoquic_quic_t* quic)
+{
+    picoquic_stored_token_index_t* index = &quic->token_index;
+
+    if (index->bins == NULL || index->indexed_first != quic->p_first_token) {
+        picoquic_stored_token_index_rebuild(quic);
+    }
+
+    return index;
+}
+
+static picoquic_stored_token_t* picoquic_stored_token_first_candidate(picoquic_quic_t* quic, uint64_t h)
+{
+    picoquic_stored_token_index_t* index = &quic->token_index;
+
+    return (index->bins == NULL) ? quic->p_first_token : index->bins[h & (index->nb_bins - 1)];
+}
+
+static picoquic_stored_token_t* picoquic_stored_token_next_candidate(picoquic_quic_t* quic, picoquic_stored_token_t* stored)
+{
+    return (quic->token_index.bins == NULL) ? stored->next_token : stored->next_in_bin;
+}
+
+static void picoquic_stored_token_push_front(picoquic_quic_t* quic, picoquic_stored_token_t* stored)
+{
+    picoquic_stored_token_index_t* index = &quic->token_index;
+
+    stored->previous_token = NULL;
+    stored->next_token = quic->p_first_token;
+    if (stored->next_token == NULL) {
+        index->last_token = stored;
+    }
+    else {
+        stored->next_token->previous_token = stored;
+    }
+    quic->p_first_token = stored;
+    index->indexed_first = stored;
+    picoquic_stored_token_bin_insert(index, stored);
+    index->nb_tokens++;
+}
+
+static void picoquic_stored_token_unlink(picoquic_quic_t* quic, picoquic_stored_token_t* stored)
+{
+    picoquic_stored_token_index_t* index = &quic->token_index;
+
+    picoquic_stored_token_bin_remove(index, stored);
+    if (stored->previous_token == NULL) {
+        quic->p_first_token = stored->next_token;
+        index->indexed_first = stored->next_token;
+    }
+    else {
+        stored->previous_token->next_token = stored->next_token;
+    }
+    if (stored->next_token == NULL) {
+        index->last_token = stored->previous_token;
+    }
+    else {
+        stored->next_token->previous_token = stored->previous_token;
+    }
+    stored->next_token = NULL;
+    stored->previous_token = NULL;
+    if (index->nb_tokens > 0) {
+        index->nb_tokens--;
+    }
+}
+
+static void picoquic_stored_token_delete(picoquic_quic_t* quic, picoquic_stored_token_t* stored)
+{
+    picoquic_stored_token_unlink(quic, stored);
+    free(stored);
+}
+
+/* Evict the least recently used tokens, but never the one just stored */
+static void picoquic_stored_token_evict(picoquic_quic_t* quic, picoquic_stored_token_t* protected_token)
+{
+    picoquic_stored_token_index_t* index = &quic->token_index;
+
+    while (index->max_tokens > 0 && index->nb_tokens > index->max_tokens &&
+        index->last_token != NULL && index->last_token != protected_token) {
+        picoquic_stored_token_delete(quic, index->last_token);
+    }
+}
+
+/* Insert a new token at the head of the store, replacing the older tokens
+ * for the same SNI and IP address */
+static void picoquic_stored_token_insert(picoquic_quic_t* quic, picoquic_stored_token_t* stored)
+{
+    picoquic_stored_token_index_t* index = picoquic_stored_token_index_check(quic);
+    picoquic_stored_token_t* next;
+
+    stored->index_hash = picoquic_stored_token_hash(quic, stored->sni, stored->sni_length);
+
+    next = picoquic_stored_token_first_candidate(quic, stored->index_hash);
+    while (next != NULL) {
+        picoquic_stored_token_t* candidate = next;
+        next = picoquic_stored_token_next_candidate(quic, next);
+        if (candidate->time_valid_until <= stored->time_valid_until && candidate->sni_length == stored->sni_length &&
+            candidate->ip_addr_length == stored->ip_addr_length && memcmp(candidate->sni, stored->sni, stored->sni_length) == 0 &&
+            memcmp(candidate->ip_addr, stored->ip_addr, stored->ip_addr_length) == 0) {
+            picoquic_stored_token_delete(quic, candidate);
+        }
+    }
+
+    picoquic_stored_token_push_front(quic, stored);
+    if (index->bins != NULL && index->nb_tokens > 2 * index->nb_bins) {
+        picoquic_stored_token_index_rebuild(quic);
+    }
+    picoquic_stored_token_evict(quic, stored);
+}
+
+void picoquic_set_token_store_max(picoquic_quic_t* quic, size_t max_tokens)
+{
+    quic->token_index.max_tokens = max_tokens;
+    (void)picoquic_stored_token_index_check(quic);
+    picoquic_stored_token_evict(quic, NULL);
+}
+
+void picoquic_free_token_index(picoquic_quic_t* quic)
+{
+    if (quic->token_index.bins != NULL) {
+        free(quic->token_index.bins);
+    }
+    memset(&quic->token_index, 0, sizeof(picoquic_stored_token_index_t));
+}
+
 int picoquic_store_token(picoquic_quic_t * quic,
     char const* sni, uint16_t sni_length,
     uint8_t const* ip_addr, uint8_t ip_addr_length,
     uint8_t const* token, uint16_t token_length)
 {
     int ret = 0;
-    picoquic_stored_token_t** pp_first_token = &quic->p_first_token;
     uint64_t current_time = picoquic_get_tls_time(quic);
 
     if (token_length < 1 || sni == NULL || sni_length == 0) {
@@ -175,26 +377,8 @@ int picoquic_store_token(picoquic_quic_t * quic,
             ret = PICOQUIC_ERROR_MEMORY;
         }
         else {
-            picoquic_stored_token_t* next;
-            picoquic_stored_token_t** pprevious;
-
-            stored->next_token = next = *pp_first_token;
-            *pp_first_token = stored;
-            pprevious = &stored->next_token;
-
-            /* Now remove the old tokens for that SNI & ip_addr */
-            while (next != NULL) {
-                if (next->time_valid_until <= stored->time_valid_until && next->sni_length == sni_length && next->ip_addr_length == ip_addr_length && memcmp(next->sni, sni, sni_length) == 0 && memcmp(next->ip_addr, ip_addr, ip_addr_length) == 0) {
-                    picoquic_stored_token_t* deleted = next;
-                    next = next->next_token;
-                    *pprevious = next;
-                    free(deleted);
-                }
-                else {
-                    pprevious = &next->next_token;
-                    next = next->next_token;
-                }
-            }
+            picoquic_stored_token_insert(quic, stored);
+            picoquic_shared_store_publish_token(quic, stored);
         }
     } 
 
@@ -209,10 +393,12 @@ int picoquic_get_token(picoquic_quic_t * quic,
     int ret = 0;
 
     uint64_t current_time = picoquic_get_tls_time(quic);
-    picoquic_stored_token_t* p_first_token = quic->p_first_token;
-    picoquic_stored_token_t* next = p_first_token;
+    picoquic_stored_token_t* next;
     picoquic_stored_token_t* best_match = NULL;
 
+    (void)picoquic_stored_token_index_check(quic);
+    next = picoquic_stored_token_first_candidate(quic, picoquic_stored_token_hash(quic, sni, sni_length));
+
     while (next != NULL) {
         if (next->time_valid_until > current_time && next->sni_length == sni_length && memcmp(next->sni, sni, sni_length) == 0 && next->was_used == 0){
             if (ip_addr_length > 0) {
@@ -227,7 +413,15 @@ int picoquic_get_token(picoquic_quic_t * quic,
                 }
             }
         } 
-        next = next->next_token;
+        next = picoquic_stored_token_next_candidate(quic, next);
+    }
+
+    if (best_match == NULL && quic->shared_store != NULL) {
+        /* Another process may have received a matching token */
+        best_match = picoquic_shared_store_fetch_token(quic, sni, sni_length, ip_addr, ip_addr_length);
+        if (best_match != NULL) {
+            picoquic_stored_token_insert(quic, best_match);
+        }
     }
 
     if (best_match == NULL || best_match->token_length == 0 || (*token = (uint8_t *)malloc(best_match->token_length)) == NULL) {
@@ -238,6 +432,14 @@ int picoquic_get_token(picoquic_quic_t * quic,
         *token_length = best_match->token_length;
         memcpy(*token, (uint8_t*)best_match->token, best_match->token_length);
         best_match->was_used = mark_used;
+        if (mark_used) {
+            picoquic_shared_store_forget_token(quic, best_match);
+        }
+        if (best_match->previous_token != NULL) {
+            /* Keep the list in least recently used order */
+            picoquic_stored_token_unlink(quic, best_match);
+            picoquic_stored_token_push_front(quic, best_match);
+        }
     }
 
     return ret;
@@ -291,6 +493,8 @@ int picoquic_load_tokens(picoquic_quic_t* quic, char const* token_file_name)
     uint64_t current_time = picoquic_get_tls_time(quic);
     picoquic_stored_token_t** pp_first_token = &quic->p_first_token;
 
+    (void)picoquic_stored_token_index_check(quic);
+
     if ((F = picoquic_file_open_ex(token_file_name, "rb", &file_ret)) == NULL) {
         ret = (file_ret == ENOENT) ? PICOQUIC_ERROR_NO_SUCH_FILE : -1;
     }
@@ -344,6 +548,10 @@ int picoquic_load_tokens(picoquic_quic_t* quic, char const* token_file_name)
 
     (void)picoquic_file_close(F);
 
+    /* The loaded tokens were appended to the list, index them all at once */
+    picoquic_stored_token_index_rebuild(quic);
+    picoquic_stored_token_evict(quic, NULL);
+
     return ret;
 }
 
@@ -0,0 +1,318 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Compact closing state.
+*
+* Once a server connection has sent its CONNECTION_CLOSE, the only remaining
+* duty of the endpoint is to answer the packets that the peer may still send,
+* until the closing timer expires (RFC 9000, section 10.2). Keeping the full
+* connection context for that, with its TLS state, stream queues and packet
+* contexts, is wasteful when many connections close at the same time. We
+* replace it by a small record holding the local connection IDs, a copy of
+* the datagram that carried the close, and the timers.
+*
+* RFC 9000 section 10.2.1 allows endpoints to send the exact same packet in
+* response to any received packet, so the record does not need any key:
+* the stored datagram is sent again at a decreasing rate, starting with the
+* same interval as the closing state of the connection. In the draining
+* state, nothing is sent, but the packets are still absorbed so that they
+* do not trigger stateless resets.
+*
+* Records are kept in arrival order, which is also approximately the order of
+* expiry. Expired records are removed from the head of the list, and when
+* found by a lookup.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+
+static uint64_t picoquic_tombstone_cid_hash(const void* key, const uint8_t* hash_seed)
+{
+    const picoquic_tombstone_cid_t* t_cid = (const picoquic_tombstone_cid_t*)key;
+    return picoquic_connection_id_hash(&t_cid->cnx_id, hash_seed);
+}
+
+static int picoquic_tombstone_cid_compare(const void* key1, const void* key2)
+{
+    const picoquic_tombstone_cid_t* t_cid1 = (const picoquic_tombstone_cid_t*)key1;
+    const picoquic_tombstone_cid_t* t_cid2 = (const picoquic_tombstone_cid_t*)key2;
+
+    return picoquic_compare_connection_id(&t_cid1->cnx_id, &t_cid2->cnx_id);
+}
+
+static picohash_item* picoquic_tombstone_cid_to_item(const void* key)
+{
+    picoquic_tombstone_cid_t* t_cid = (picoquic_tombstone_cid_t*)key;
+
+    return &t_cid->hash_item;
+}
+
+int picoquic_set_compact_closing(picoquic_quic_t* quic, int enable, size_t max_records)
+{
+    int ret = 0;
+
+    if (!enable) {
+        picoquic_tombstone_free(quic);
+    }
+    else {
+        if (max_records == 0) {
+            max_records = quic->max_number_connections;
+        }
+        if (quic->tombstones == NULL) {
+            quic->tombstones = (picoquic_tombstone_ctx_t*)malloc(sizeof(picoquic_tombstone_ctx_t));
+            if (quic->tombstones != NULL) {
+                memset(quic->tombstones, 0, sizeof(picoquic_tombstone_ctx_t));
+                quic->tombstones->table = picohash_create_open(max_records, picoquic_tombstone_cid_hash,
+                    picoquic_tombstone_cid_compare, picoquic_tombstone_cid_to_item, quic->hash_seed);
+                if (quic->tombstones->table == NULL) {
+                    free(quic->tombstones);
+                    quic->tombstones = NULL;
+                }
+            }
+        }
+        if (quic->tombstones == NULL) {
+            DBG_PRINTF("%s", "Cannot allocate the compact closing context\n");
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            quic->tombstones->max_records = (max_records == 0) ? 1 : max_records;
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_get_compact_closing_stats(picoquic_quic_t* quic, picoquic_compact_closing_stats_t* stats)
+{
+    if (quic->tombstones == NULL) {
+        memset(stats, 0, sizeof(picoquic_compact_closing_stats_t));
+    }
+    else {
+        *stats = quic->tombstones->stats;
+    }
+}
+
+static void picoquic_tombstone_delete(picoquic_tombstone_ctx_t* ctx, picoquic_tombstone_t* tombstone)
+{
+    for (size_t i = 0; i < tombstone->nb_cid; i++) {
+        picohash_delete_key(ctx->table, &tombstone->cid[i], 0);
+    }
+
+    if (tombstone->previous == NULL) {
+        ctx->first = tombstone->next;
+    }
+    else {
+        tombstone->previous->next = tombstone->next;
+    }
+    if (tombstone->next == NULL) {
+        ctx->last = tombstone->previous;
+    }
+    else {
+        tombstone->next->previous = tombstone->previous;
+    }
+    ctx->stats.nb_current--;
+    free(tombstone);
+}
+
+static size_t picoquic_tombstone_count_cid(picoquic_cnx_t* cnx)
+{
+    size_t nb_cid = 0;
+    picoquic_local_cnxid_list_t* local_cnxid_list = cnx->first_local_cnxid_list;
+
+    while (local_cnxid_list != NULL) {
+        picoquic_local_cnxid_t* l_cid = local_cnxid_list->local_cnxid_first;
+        while (l_cid != NULL) {
+            if (!picoquic_is_connection_id_null(&l_cid->cnx_id)) {
+                nb_cid++;
+            }
+            l_cid = l_cid->next;
+        }
+        local_cnxid_list = local_cnxid_list->next_list;
+    }
+
+    return nb_cid;
+}
+
+/* Create the record of a server connection that just sent its close. Returns 0
+ * if the record was created, in which case the caller deletes the connection.
+ */
+int picoquic_tombstone_create(picoquic_cnx_t* cnx, const uint8_t* bytes, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_tombstone_ctx_t* ctx = cnx->quic->tombstones;
+    picoquic_path_t* path_x = cnx->path[0];
+    uint64_t expiry_time = cnx->latest_progress_time + 3 * path_x->retransmit_timer;
+    size_t nb_cid = picoquic_tombstone_count_cid(cnx);
+    picoquic_tombstone_t* tombstone = NULL;
+
+    if (ctx == NULL || nb_cid == 0 || length == 0 || expiry_time <= current_time) {
+        ret = -1;
+    }
+    else if ((tombstone = (picoquic_tombstone_t*)malloc(sizeof(picoquic_tombstone_t) +
+        nb_cid * sizeof(picoquic_tombstone_cid_t) + length)) == NULL) {
+        DBG_PRINTF("%s", "Cannot allocate a closing record\n");
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        picoquic_local_cnxid_list_t* local_cnxid_list = cnx->first_local_cnxid_list;
+        uint64_t resend_interval = path_x->rtt_min;
+
+        if (resend_interval * 2 < path_x->retransmit_timer) {
+            resend_interval = path_x->retransmit_timer / 2;
+        }
+
+        memset(tombstone, 0, sizeof(picoquic_tombstone_t));
+        tombstone->expiry_time = expiry_time;
+        tombstone->resend_interval = resend_interval;
+        tombstone->next_send_time = current_time + resend_interval;
+        tombstone->initial_cnxid = cnx->initial_cnxid;
+        tombstone->is_draining = (cnx->cnx_state == picoquic_state_draining);
+        tombstone->cid = (picoquic_tombstone_cid_t*)(tombstone + 1);
+        tombstone->close_bytes = (uint8_t*)(tombstone->cid + nb_cid);
+        tombstone->close_length = length;
+        memcpy(tombstone->close_bytes, bytes, length);
+
+        /* Make room, oldest records first */
+        while (ctx->first != NULL && ctx->stats.nb_current >= ctx->max_records) {
+            picoquic_tombstone_delete(ctx, ctx->first);
+            ctx->stats.nb_evicted++;
+        }
+
+        while (local_cnxid_list != NULL) {
+            picoquic_local_cnxid_t* l_cid = local_cnxid_list->local_cnxid_first;
+            while (l_cid != NULL && tombstone->nb_cid < nb_cid) {
+                if (!picoquic_is_connection_id_null(&l_cid->cnx_id)) {
+                    picoquic_tombstone_cid_t* t_cid = &tombstone->cid[tombstone->nb_cid];
+                    memset(t_cid, 0, sizeof(picoquic_tombstone_cid_t));
+                    t_cid->cnx_id = l_cid->cnx_id;
+                    t_cid->tombstone = tombstone;
+                    /* A CID already present belongs to an older record, which is about to expire */
+                    if (picohash_retrieve(ctx->table, t_cid) == NULL &&
+                        picohash_insert(ctx->table, t_cid) == 0) {
+                        tombstone->nb_cid++;
+                    }
+                }
+                l_cid = l_cid->next;
+            }
+            local_cnxid_list = local_cnxid_list->next_list;
+        }
+
+        tombstone->previous = ctx->last;
+        if (ctx->last == NULL) {
+            ctx->first = tombstone;
+        }
+        else {
+            ctx->last->next = tombstone;
+        }
+        ctx->last = tombstone;
+        ctx->stats.nb_current++;
+        ctx->stats.nb_created++;
+
+        if (tombstone->nb_cid == 0) {
+            picoquic_tombstone_delete(ctx, tombstone);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Handle a packet whose destination CID did not match any connection.
+ * Returns 1 if the CID belongs to a closed connection, in which case the
+ * packet shall not trigger a stateless reset.
+ */
+int picoquic_tombstone_incoming(picoquic_quic_t* quic, const picoquic_connection_id_t* dest_cnx_id, size_t length,
+    const struct sockaddr* addr_from, const struct sockaddr* addr_to, int if_index_to, uint64_t current_time)
+{
+    int is_closed = 0;
+    picoquic_tombstone_ctx_t* ctx = quic->tombstones;
+    picoquic_tombstone_cid_t key;
+    picohash_item* item;
+
+    memset(&key, 0, sizeof(key));
+    key.cnx_id = *dest_cnx_id;
+
+    if (ctx != NULL && (item = picohash_retrieve(ctx->table, &key)) != NULL) {
+        picoquic_tombstone_t* tombstone = ((picoquic_tombstone_cid_t*)item->key)->tombstone;
+
+        if (tombstone->expiry_time <= current_time) {
+            picoquic_tombstone_delete(ctx, tombstone);
+            ctx->stats.nb_expired++;
+        }
+        else {
+            picoquic_stateless_packet_t* sp = NULL;
+
+            is_closed = 1;
+            /* Do not answer in draining state, and do not amplify spoofed packets */
+            if (tombstone->is_draining || current_time < tombstone->next_send_time ||
+                tombstone->close_length > 3 * length ||
+                (sp = picoquic_create_stateless_packet(quic)) == NULL) {
+                ctx->stats.nb_absorbed++;
+            }
+            else {
+                memcpy(sp->bytes, tombstone->close_bytes, tombstone->close_length);
+                sp->length = tombstone->close_length;
+                sp->ptype = picoquic_packet_1rtt_protected;
+                picoquic_store_addr(&sp->addr_to, addr_from);
+                picoquic_store_addr(&sp->addr_local, addr_to);
+                sp->if_index_local = if_index_to;
+                sp->initial_cid = tombstone->initial_cnxid;
+                sp->cnxid_log64 = picoquic_val64_connection_id(sp->initial_cid);
+                picoquic_queue_stateless_packet(quic, sp);
+
+                tombstone->next_send_time = current_time + tombstone->resend_interval;
+                tombstone->resend_interval *= 2;
+                ctx->stats.nb_close_resent++;
+            }
+        }
+    }
+
+    return is_closed;
+}
+
+void picoquic_tombstone_purge(picoquic_quic_t* quic, uint64_t current_time)
+{
+    picoquic_tombstone_ctx_t* ctx = quic->tombstones;
+
+    if (ctx != NULL) {
+        while (ctx->first != NULL && ctx->first->expiry_time <= current_time) {
+            picoquic_tombstone_delete(ctx, ctx->first);
+            ctx->stats.nb_expired++;
+        }
+    }
+}
+
+void picoquic_tombstone_free(picoquic_quic_t* quic)
+{
+    picoquic_tombstone_ctx_t* ctx = quic->tombstones;
+
+    if (ctx != NULL) {
+        while (ctx->first != NULL) {
+            picoquic_tombstone_delete(ctx, ctx->first);
+        }
+        picohash_delete(ctx->table, 0);
+        free(ctx);
+        quic->tombstones = NULL;
+    }
+}
@@ -26,6 +26,7 @@
 #include "picoquic_internal.h"
 #include "picoquic_unified_log.h"
 #include "tls_api.h"
+#include <stdlib.h>
 #include <string.h>
 
 uint64_t picoquic_transport_param_varint_decode(picoquic_cnx_t * cnx, uint8_t* bytes, uint64_t extension_length, int* ret) 
@@ -303,13 +304,18 @@ int picoquic_negotiate_multipath_option(picoquic_cnx_t* cnx)
     return ret;
 }
 
-int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mode,
-    uint8_t* bytes, size_t bytes_length, size_t* consumed)
+/* The server transport parameters are the same for all connections created
+ * with the same local parameters, except for the connection identifiers and
+ * the stateless reset token. The encoding is split in three parts: the
+ * parameters before the connection identifiers, the connection identifiers
+ * and reset token, and the parameters after them. The first and last parts
+ * are cached in the QUIC context, and reused by the next connections when
+ * the local parameters match; only the middle part is encoded again.
+ * Connection identifiers have variable lengths, so they are encoded between
+ * the cached parts rather than patched in a fixed template.
+ */
+static uint8_t* picoquic_prepare_tp_prefix(picoquic_cnx_t* cnx, uint8_t* bytes, uint8_t* bytes_max)
 {
-    int ret = 0;
-    uint8_t* bytes_zero = bytes;
-    uint8_t* bytes_max = bytes + bytes_length;
-
     bytes = picoquic_transport_param_type_varint_encode(bytes, bytes_max, picoquic_tp_initial_max_stream_data_bidi_local,
         cnx->local_parameters.initial_max_stream_data_bidi_local);
 
@@ -367,6 +373,12 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
         bytes = picoquic_transport_param_type_varint_encode(bytes, bytes_max, picoquic_tp_max_ack_delay,
             (cnx->local_parameters.max_ack_delay + 999) / 1000); /* Max ACK delay in milliseconds */
     }
+
+    return bytes;
+}
+
+static uint8_t* picoquic_prepare_tp_cids(picoquic_cnx_t* cnx, int extension_mode, uint8_t* bytes, uint8_t* bytes_max)
+{
     bytes = picoquic_transport_param_cid_encode(bytes, bytes_max, picoquic_tp_handshake_connection_id, &cnx->path[0]->first_tuple->p_local_cnxid->cnx_id);
 
     if (extension_mode == 1){
@@ -393,11 +405,11 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
         }
     }
 
-    if (!cnx->client_mode && cnx->local_parameters.max_datagram_frame_size == 0 &&
-        cnx->remote_parameters.max_datagram_frame_size > 0) {
-        cnx->local_parameters.max_datagram_frame_size = PICOQUIC_MAX_PACKET_SIZE;
-    }
+    return bytes;
+}
 
+static uint8_t* picoquic_prepare_tp_suffix(picoquic_cnx_t* cnx, int extension_mode, uint8_t* bytes, uint8_t* bytes_max)
+{
     if (cnx->local_parameters.max_datagram_frame_size > 0 && bytes != NULL) {
         bytes = picoquic_transport_param_type_varint_encode(bytes, bytes_max, picoquic_tp_max_datagram_frame_size,
             cnx->local_parameters.max_datagram_frame_size);
@@ -454,6 +466,11 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
             (uint64_t)cnx->local_parameters.enable_bdp_frame);
     }
 
+    if (cnx->local_parameters.enable_fec > 0 && bytes != NULL) {
+        bytes = picoquic_transport_param_type_varint_encode(bytes, bytes_max, picoquic_tp_enable_fec,
+            (uint64_t)cnx->local_parameters.enable_fec);
+    }
+
     if (cnx->local_parameters.is_multipath_enabled > 0 && bytes != NULL){
         bytes = picoquic_transport_param_type_varint_encode(bytes, bytes_max, 
             picoquic_tp_initial_max_path_id,
@@ -484,6 +501,112 @@ int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
         }
     }
 
+    return bytes;
+}
+
+static int picoquic_tp_cache_is_usable(picoquic_cnx_t* cnx, int extension_mode)
+{
+    /* Greasing and test options depend on the connection or on the available space */
+    return (extension_mode == 1 && !cnx->grease_transport_parameters && !cnx->test_large_chello &&
+        !cnx->quic->test_large_server_flight);
+}
+
+static int picoquic_tp_cache_matches(picoquic_tp_cache_t* tp_cache, picoquic_cnx_t* cnx)
+{
+    return (tp_cache != NULL && tp_cache->is_valid &&
+        tp_cache->version_index == cnx->version_index &&
+        tp_cache->do_version_negotiation == cnx->do_version_negotiation &&
+        memcmp(&tp_cache->local_parameters, &cnx->local_parameters, sizeof(picoquic_tp_t)) == 0);
+}
+
+static void picoquic_tp_cache_update(picoquic_cnx_t* cnx, const uint8_t* prefix, size_t prefix_length,
+    const uint8_t* suffix, size_t suffix_length)
+{
+    picoquic_tp_cache_t* tp_cache = cnx->quic->tp_cache;
+
+    if (tp_cache == NULL) {
+        tp_cache = (picoquic_tp_cache_t*)malloc(sizeof(picoquic_tp_cache_t));
+        if (tp_cache != NULL) {
+            memset(tp_cache, 0, sizeof(picoquic_tp_cache_t));
+            cnx->quic->tp_cache = tp_cache;
+        }
+    }
+
+    if (tp_cache != NULL) {
+        if (prefix_length > sizeof(tp_cache->prefix) || suffix_length > sizeof(tp_cache->suffix)) {
+            tp_cache->is_valid = 0;
+        }
+        else {
+            memcpy(&tp_cache->local_parameters, &cnx->local_parameters, sizeof(picoquic_tp_t));
+            tp_cache->version_index = cnx->version_index;
+            tp_cache->do_version_negotiation = cnx->do_version_negotiation;
+            memcpy(tp_cache->prefix, prefix, prefix_length);
+            tp_cache->prefix_length = prefix_length;
+            memcpy(tp_cache->suffix, suffix, suffix_length);
+            tp_cache->suffix_length = suffix_length;
+            tp_cache->is_valid = 1;
+        }
+    }
+}
+
+void picoquic_tp_cache_free(picoquic_quic_t* quic)
+{
+    if (quic->tp_cache != NULL) {
+        free(quic->tp_cache);
+        quic->tp_cache = NULL;
+    }
+}
+
+int picoquic_prepare_transport_extensions(picoquic_cnx_t* cnx, int extension_mode,
+    uint8_t* bytes, size_t bytes_length, size_t* consumed)
+{
+    int ret = 0;
+    uint8_t* bytes_zero = bytes;
+    uint8_t* bytes_max = bytes + bytes_length;
+    int use_cache = picoquic_tp_cache_is_usable(cnx, extension_mode);
+
+    if (!cnx->client_mode && cnx->local_parameters.max_datagram_frame_size == 0 &&
+        cnx->remote_parameters.max_datagram_frame_size > 0) {
+        cnx->local_parameters.max_datagram_frame_size = PICOQUIC_MAX_PACKET_SIZE;
+    }
+
+    if (use_cache && picoquic_tp_cache_matches(cnx->quic->tp_cache, cnx)) {
+        picoquic_tp_cache_t* tp_cache = cnx->quic->tp_cache;
+
+        if (tp_cache->prefix_length > bytes_length) {
+            bytes = NULL;
+        }
+        else {
+            memcpy(bytes, tp_cache->prefix, tp_cache->prefix_length);
+            bytes += tp_cache->prefix_length;
+            bytes = picoquic_prepare_tp_cids(cnx, extension_mode, bytes, bytes_max);
+        }
+        if (bytes != NULL) {
+            if (bytes + tp_cache->suffix_length > bytes_max) {
+                bytes = NULL;
+            }
+            else {
+                memcpy(bytes, tp_cache->suffix, tp_cache->suffix_length);
+                bytes += tp_cache->suffix_length;
+                tp_cache->nb_hits++;
+            }
+        }
+    }
+    else {
+        uint8_t* cids_start;
+        uint8_t* cids_end;
+
+        bytes = picoquic_prepare_tp_prefix(cnx, bytes, bytes_max);
+        cids_start = bytes;
+        bytes = picoquic_prepare_tp_cids(cnx, extension_mode, bytes, bytes_max);
+        cids_end = bytes;
+        bytes = picoquic_prepare_tp_suffix(cnx, extension_mode, bytes, bytes_max);
+
+        if (use_cache && bytes != NULL) {
+            picoquic_tp_cache_update(cnx, bytes_zero, cids_start - bytes_zero, cids_end, bytes - cids_end);
+        }
+    }
+
     if (bytes == NULL) {
         *consumed = 0;
         ret = PICOQUIC_ERROR_EXTENSION_BUFFER_TOO_SMALL;
@@ -523,6 +646,7 @@ void picoquic_clear_transport_extensions(picoquic_cnx_t* cnx)
     cnx->remote_parameters.do_grease_quic_bit = 0;
     cnx->remote_parameters.enable_bdp_frame = 0;
     cnx->remote_parameters.initial_max_path_id = 0;
+    cnx->remote_parameters.enable_fec = 0;
 }
 
 int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mode,
@@ -804,6 +928,19 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
                     }
                     break;
                 }
+                case picoquic_tp_enable_fec: {
+                    uint64_t enable_fec =
+                        picoquic_transport_param_varint_decode(cnx, bytes + byte_index, extension_length, &ret);
+                    if (ret == 0) {
+                        if (enable_fec > 1) {
+                            ret = picoquic_connection_error_ex(cnx, PICOQUIC_TRANSPORT_PARAMETER_ERROR, 0, "FEC parameter");
+                        }
+                        else {
+                            cnx->remote_parameters.enable_fec = (int)enable_fec;
+                        }
+                    }
+                    break;
+                }
                 case picoquic_tp_address_discovery: {
                     uint64_t address_discovery_mode =
                         picoquic_transport_param_varint_decode(cnx, bytes + byte_index, extension_length, &ret);
@@ -943,6 +1080,10 @@ int picoquic_receive_transport_extensions(picoquic_cnx_t* cnx, int extension_mod
     /* Send-receive BDP frame is only enabled if negotiated by both parties */
     cnx->send_receive_bdp_frame = (cnx->local_parameters.enable_bdp_frame > 0) && (cnx->remote_parameters.enable_bdp_frame > 0);
 
+    /* FEC is only enabled if negotiated by both parties, and not combined with multipath */
+    cnx->is_fec_negotiated = (cnx->local_parameters.enable_fec > 0) && (cnx->remote_parameters.enable_fec > 0) &&
+        !cnx->is_multipath_enabled;
+
     /* One way delay, Quic_bit_grease and Multipath only enabled if asked by client and accepted by server */
     if (cnx->client_mode) {
         cnx->is_time_stamp_enabled = 
@@ -45,7 +45,7 @@ void picoquic_log_close_logs(picoquic_quic_t* quic)
 void picoquic_log_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t current_time, uint64_t cid64,
     const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length)
 {
-    if (quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(quic)) {
         quic->text_log_fns->log_quic_pdu(quic, receiving, current_time, cid64, addr_peer, addr_local, packet_length);
     }
 }
@@ -54,25 +54,25 @@ void picoquic_log_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t curren
 
 void picoquic_log_app_message_v(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         cnx->quic->text_log_fns->log_app_message(cnx, fmt, vargs);
     }
 
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         cnx->quic->bin_log_fns->log_app_message(cnx, fmt, vargs);
     }
 }
 
 void picoquic_log_app_message(picoquic_cnx_t* cnx, const char* fmt, ...)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         va_list args;
         va_start(args, fmt);
         cnx->quic->text_log_fns->log_app_message(cnx, fmt, args);
         va_end(args);
     }
 
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         va_list args;
         va_start(args, fmt);
         cnx->quic->bin_log_fns->log_app_message(cnx, fmt, args);
@@ -82,7 +82,7 @@ void picoquic_log_app_message(picoquic_cnx_t* cnx, const char* fmt, ...)
 
 void picoquic_log_context_free_app_message(picoquic_quic_t* quic, const picoquic_connection_id_t* cid, const char* fmt, ...)
 {
-    if (quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(quic)) {
         va_list args;
         va_start(args, fmt);
         quic->text_log_fns->log_quic_app_message(quic, cid, fmt, args);
@@ -96,12 +96,12 @@ void picoquic_log_pdu(picoquic_cnx_t* cnx, int receiving, uint64_t current_time,
     uint64_t unique_path_id)
 {
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_pdu(cnx, receiving, current_time, addr_peer, addr_local, packet_length,
                 unique_path_id);
         }
 
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_pdu(cnx, receiving, current_time, addr_peer, addr_local, packet_length, 
                 unique_path_id);
         }
@@ -113,11 +113,11 @@ void picoquic_log_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int recei
     struct st_picoquic_packet_header_t* ph, const uint8_t* bytes, size_t bytes_max)
 {
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_packet(cnx, path_x, receiving, current_time, ph, bytes, bytes_max);
         }
 
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_packet(cnx, path_x, receiving, current_time, ph, bytes, bytes_max);
         }
     }
@@ -128,11 +128,11 @@ void picoquic_log_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, s
     int err, uint8_t* raw_data, uint64_t current_time)
 {
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_dropped_packet(cnx, path_x, ph, packet_size, err, raw_data, current_time);
         }
 
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_dropped_packet(cnx, path_x, ph, packet_size, err, raw_data, current_time);
         }
     }
@@ -142,11 +142,11 @@ void picoquic_log_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, s
 void picoquic_log_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_type_enum ptype, uint64_t current_time)
 {
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_buffered_packet(cnx, path_x, ptype, current_time);
         }
 
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_buffered_packet(cnx, path_x, ptype, current_time);
         }
     }
@@ -158,12 +158,12 @@ void picoquic_log_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     uint8_t* send_buffer, size_t send_length, uint64_t current_time)
 {
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_outgoing_packet(cnx, path_x, bytes, sequence_number, pn_length, length,
                 send_buffer, send_length, current_time);
         }
 
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_outgoing_packet(cnx, path_x, bytes, sequence_number, pn_length, length,
                 send_buffer, send_length, current_time);
         }
@@ -177,11 +177,11 @@ void picoquic_log_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     uint64_t current_time)
 {
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_packet_lost(cnx, path_x, ptype, sequence_number, trigger, dcid, packet_size, current_time);
         }
 
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_packet_lost(cnx, path_x, ptype, sequence_number, trigger, dcid, packet_size, current_time);
         }
     }
@@ -192,11 +192,11 @@ void picoquic_log_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
     uint8_t const* sni, size_t sni_len, uint8_t const* alpn, size_t alpn_len,
     const ptls_iovec_t* alpn_list, size_t alpn_count)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         cnx->quic->text_log_fns->log_negotiated_alpn(cnx, is_local, sni, sni_len, alpn, alpn_len, alpn_list, alpn_count);
     }
 
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         cnx->quic->bin_log_fns->log_negotiated_alpn(cnx, is_local, sni, sni_len, alpn, alpn_len, alpn_list, alpn_count);
     }
 }
@@ -205,11 +205,11 @@ void picoquic_log_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
 void picoquic_log_transport_extension(picoquic_cnx_t* cnx, int is_local,
     size_t param_length, uint8_t* params)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         cnx->quic->text_log_fns->log_transport_extension(cnx, is_local, param_length, params);
     }
 
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         cnx->quic->bin_log_fns->log_transport_extension(cnx, is_local, param_length, params);
     }
 }
@@ -217,11 +217,11 @@ void picoquic_log_transport_extension(picoquic_cnx_t* cnx, int is_local,
 /* log TLS ticket */
 void picoquic_log_tls_ticket(picoquic_cnx_t* cnx, uint8_t* ticket, uint16_t ticket_length)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         cnx->quic->text_log_fns->log_picotls_ticket(cnx, ticket, ticket_length);
     }
 
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         cnx->quic->bin_log_fns->log_picotls_ticket(cnx, ticket, ticket_length);
     }
 }
@@ -229,7 +229,7 @@ void picoquic_log_tls_ticket(picoquic_cnx_t* cnx, uint8_t* ticket, uint16_t tick
 /* log the start of a connection */
 void picoquic_log_new_connection(picoquic_cnx_t* cnx)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         cnx->quic->text_log_fns->log_new_connection(cnx);
     }
 
@@ -240,11 +240,11 @@ void picoquic_log_new_connection(picoquic_cnx_t* cnx)
 /* log the end of a connection */
 void picoquic_log_close_connection(picoquic_cnx_t* cnx)
 {
-    if (cnx->quic->F_log != NULL) {
+    if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
         cnx->quic->text_log_fns->log_close_connection(cnx);
     }
 
-    if (cnx->f_binlog != NULL) {
+    if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
         cnx->quic->bin_log_fns->log_close_connection(cnx);
     }
 }
@@ -255,11 +255,14 @@ void picoquic_log_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
     if (cnx->memlog_call_back != NULL) {
         cnx->memlog_call_back(cnx, cnx->path[0], cnx->memlog_ctx, 0, current_time);
     }
+    if (cnx->quic->memlog_call_back != NULL) {
+        cnx->quic->memlog_call_back(cnx, cnx->path[0], cnx->quic->memlog_ctx, 0, current_time);
+    }
     if (picoquic_cnx_is_still_logging(cnx)) {
-        if (cnx->quic->F_log != NULL) {
+        if (PICOQUIC_QUIC_IS_TEXT_LOGGING(cnx->quic)) {
             cnx->quic->text_log_fns->log_cc_dump(cnx, current_time);
         }
-        if (cnx->f_binlog != NULL) {
+        if (PICOQUIC_CNX_IS_BINLOGGING(cnx)) {
             cnx->quic->bin_log_fns->log_cc_dump(cnx, current_time);
         }
     }
@@ -437,6 +437,26 @@ uint64_t picoquic_hash_addr(const struct sockaddr* addr, const uint8_t* hash_see
     uint64_t h = picohash_siphash(bytes, (uint32_t)l, hash_seed);
     return h;
 }
+
+uint64_t picoquic_hash_addr_siphash13(const struct sockaddr* addr, const uint8_t* hash_seed)
+{
+    uint8_t bytes[18];
+    size_t l = picoquic_hash_addr_bytes(addr, bytes);
+
+    /* The fixed length variants avoid the generic tail handling for the
+     * common IPv4 and IPv6 cases. */
+    uint64_t h;
+    if (l == 6) {
+        h = picohash_siphash13_6(bytes, hash_seed);
+    }
+    else if (l == 18) {
+        h = picohash_siphash13_18(bytes, hash_seed);
+    }
+    else {
+        h = picohash_siphash13(bytes, l, hash_seed);
+    }
+    return h;
+}
 #if 0
 int picoquic_compare_addr(const struct sockaddr * expected, const struct sockaddr * actual)
 {
@@ -745,7 +765,11 @@ const uint8_t* picoquic_frames_varint_decode(const uint8_t* bytes, const uint8_t
 {
     uint8_t length;
 
-    if (bytes < bytes_max && bytes + (length = VARINT_LEN_T(bytes, uint8_t)) <= bytes_max) {
+    if (bytes_max - bytes >= 8) {
+        *n64 = PICOPARSE_VARINT_8(bytes);
+        bytes += VARINT_LEN_T(bytes, uint8_t);
+    }
+    else if (bytes < bytes_max && bytes + (length = VARINT_LEN_T(bytes, uint8_t)) <= bytes_max) {
         uint64_t v = *bytes++ & 0x3F;
 
         while (--length > 0) {
@@ -762,6 +786,23 @@ const uint8_t* picoquic_frames_varint_decode(const uint8_t* bytes, const uint8_t
     return bytes;
 }
 
+/* Parse "nb_values" consecutive varints, such as the ranges and gaps of an ACK frame.
+ * Returns NULL if the buffer is too short, in which case the content of "values" is undefined. */
+const uint8_t* picoquic_frames_varint_decode_batch(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* values, size_t nb_values)
+{
+    size_t i = 0;
+
+    while (i < nb_values && bytes_max - bytes >= 8) {
+        values[i++] = PICOPARSE_VARINT_8(bytes);
+        bytes += VARINT_LEN_T(bytes, uint8_t);
+    }
+    while (i < nb_values && bytes != NULL) {
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, &values[i++]);
+    }
+
+    return bytes;
+}
+
 const uint8_t* picoquic_frames_varlen_decode(const uint8_t* bytes, const uint8_t* bytes_max, size_t* n)
 {
     uint64_t len = 0;
@@ -844,7 +885,6 @@ const uint8_t* picoquic_frames_cid_decode(const uint8_t* bytes, const uint8_t* b
     return bytes;
 }
 
-#if 0
 /* Predict length of a varint encoding */
 size_t picoquic_frames_varint_encode_length(uint64_t n64)
 {
@@ -864,7 +904,6 @@ size_t picoquic_frames_varint_encode_length(uint64_t n64)
 
     return len;
 }
-#endif
 
 /* Encoding functions of the form uint8_t * picoquic_frame_XXX_encode(uint8_t * bytes, uint8_t * bytes-max, ...)
  */
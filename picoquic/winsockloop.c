@@ -445,7 +445,7 @@ int picoquic_packet_loop_win(picoquic_quic_t* quic,
         if (sock_ctx[0]->supports_udp_send_coalesced) {
             send_buffer_size *= 10;
         }
-        ret = picoquic_socks_create_send_ctx_list(PICOQUIC_PACKET_LOOP_SEND_MAX, send_buffer_size,
+        ret = picoquic_socks_create_send_ctx_list((int)picoquic_get_packet_loop_send_max(quic), send_buffer_size,
             &send_ctx_first, &send_ctx_last);
     }
 
@@ -0,0 +1,431 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* End to end throughput over loopback sockets.
+*
+* The server runs in one network thread and the client in another, both
+* using the production socket loop, so the results reflect the cost of the
+* system calls and of the socket options (GSO, GRO, batching of messages)
+* as well as the cost of the stack. Each connection opens stream 0, sends
+* a one byte request, and the server answers with its share of the volume.
+*
+* For reproducible results, the cipher suite is fixed, and the two threads
+* can be pinned to specific CPUs. The CPU time of each thread is read at
+* the end of the transfer, and reported as a share of the transfer time,
+* as nanoseconds per byte, and on x86 as cycles per byte. The cycles are
+* derived from the time stamp counter, i.e., counted at nominal frequency.
+*/
+
+#ifndef _WINDOWS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Required for pthread_setaffinity_np */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#else
+#include <WinSock2.h>
+#include <Windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picoquic_packet_loop.h"
+#include "picoquic_bench.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BENCH_LOOPBACK_TSC_CYCLES
+#endif
+
+#define BENCH_LOOPBACK_ALPN "picoquic-bench"
+#define BENCH_LOOPBACK_SNI "test.example.com"
+
+typedef struct st_bench_loopback_side_t {
+    bench_loopback_param_t* param;
+    int is_server;
+    int nb_cnx;
+    uint64_t volume_per_cnx;
+    /* Transfer state, only accessed by the network thread */
+    int nb_finished;
+    int nb_closed;
+    uint64_t nb_bytes;
+    uint64_t nb_packets_sent;
+    uint64_t nb_packets_received;
+    /* Measurement */
+    uint64_t start_time;
+    uint64_t end_time;
+    uint64_t start_cpu;
+    uint64_t end_cpu;
+    uint64_t start_ticks;
+    uint64_t end_ticks;
+    volatile int is_measured;
+} bench_loopback_side_t;
+
+static void bench_loopback_pin_thread(int cpu)
+{
+    if (cpu >= 0) {
+#ifdef _WINDOWS
+        if (SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR)1) << cpu) == 0) {
+            DBG_PRINTF("Cannot pin thread to CPU %d", cpu);
+        }
+#elif defined(__linux__)
+        cpu_set_t cpu_set;
+
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+            DBG_PRINTF("Cannot pin thread to CPU %d", cpu);
+        }
+#else
+        DBG_PRINTF("Cannot pin thread to CPU %d on this platform", cpu);
+#endif
+    }
+}
+
+static void bench_loopback_start_measure(bench_loopback_side_t* side)
+{
+    side->start_time = picoquic_current_time();
+    side->start_cpu = picoquic_thread_cpu_time();
+    side->start_ticks = picoquic_cpu_ticks();
+}
+
+static void bench_loopback_end_measure(bench_loopback_side_t* side)
+{
+    side->end_time = picoquic_current_time();
+    side->end_cpu = picoquic_thread_cpu_time();
+    side->end_ticks = picoquic_cpu_ticks();
+    side->is_measured = 1;
+}
+
+static int bench_loopback_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+    int ret = 0;
+    bench_loopback_side_t* side = (bench_loopback_side_t*)callback_ctx;
+
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(v_stream_ctx);
+#endif
+
+    switch (fin_or_event) {
+    case picoquic_callback_stream_data:
+    case picoquic_callback_stream_fin:
+        if (side->is_server) {
+            /* The request is ignored, all responses have the same size */
+            if (fin_or_event == picoquic_callback_stream_fin) {
+                ret = picoquic_mark_active_stream(cnx, stream_id, 1, NULL);
+            }
+        }
+        else {
+            side->nb_bytes += length;
+            if (fin_or_event == picoquic_callback_stream_fin) {
+                side->nb_finished++;
+                if (side->nb_finished >= side->nb_cnx) {
+                    bench_loopback_end_measure(side);
+                }
+                ret = picoquic_close(cnx, 0);
+            }
+        }
+        break;
+    case picoquic_callback_prepare_to_send:
+        if (side->is_server) {
+            picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+            uint64_t available = (stream == NULL || stream->sent_offset >= side->volume_per_cnx) ? 0 :
+                side->volume_per_cnx - stream->sent_offset;
+            int is_fin = 1;
+            uint8_t* buffer;
+
+            if (available > length) {
+                available = length;
+                is_fin = 0;
+            }
+            buffer = picoquic_provide_stream_data_buffer(bytes, (size_t)available, is_fin, !is_fin);
+            if (buffer != NULL) {
+                memset(buffer, 0x5a, (size_t)available);
+                side->nb_bytes += available;
+            }
+        }
+        break;
+    case picoquic_callback_stateless_reset:
+    case picoquic_callback_close:
+    case picoquic_callback_application_close:
+        if (!side->is_server || !side->is_measured) {
+            side->nb_packets_sent += cnx->nb_packets_sent;
+            side->nb_packets_received += cnx->nb_packets_received;
+        }
+        side->nb_closed++;
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+static int bench_loopback_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
+    void* callback_ctx, void* callback_arg)
+{
+    int ret = 0;
+    bench_loopback_side_t* side = (bench_loopback_side_t*)callback_ctx;
+
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(quic);
+    UNREFERENCED_PARAMETER(callback_arg);
+#endif
+
+    switch (cb_mode) {
+    case picoquic_packet_loop_ready:
+        bench_loopback_pin_thread((side->is_server) ? side->param->server_cpu : side->param->client_cpu);
+        bench_loopback_start_measure(side);
+        break;
+    case picoquic_packet_loop_after_receive:
+    case picoquic_packet_loop_after_send:
+        if (!side->is_server && side->nb_closed >= side->nb_cnx) {
+            ret = PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+/* Executed in the server thread, once the client is done. The packets of
+ * the connections that are not yet closed are counted here. */
+static void bench_loopback_server_measure(picoquic_quic_t* quic, void* app_ctx)
+{
+    bench_loopback_side_t* side = (bench_loopback_side_t*)app_ctx;
+    picoquic_cnx_t* cnx = picoquic_get_first_cnx(quic);
+
+    while (cnx != NULL) {
+        side->nb_packets_sent += cnx->nb_packets_sent;
+        side->nb_packets_received += cnx->nb_packets_received;
+        cnx = picoquic_get_next_cnx(cnx);
+    }
+    bench_loopback_end_measure(side);
+}
+
+static void bench_loopback_sleep_msec(int msec)
+{
+#ifdef _WINDOWS
+    Sleep(msec);
+#else
+    usleep(msec * 1000);
+#endif
+}
+
+static void bench_loopback_print_side(bench_loopback_side_t* side, char const* side_name, uint64_t transfer_time)
+{
+    double seconds = ((double)transfer_time) / 1000000.0;
+    double cpu_us = (double)(side->end_cpu - side->start_cpu);
+    double nb_bytes = (double)((side->nb_bytes > 0) ? side->nb_bytes : 1);
+
+    printf("  %-7s %12.0f %12.0f %8.1f %10.2f", side_name,
+        ((double)side->nb_packets_sent) / seconds, ((double)side->nb_packets_received) / seconds,
+        (side->end_cpu == 0) ? 0.0 : 100.0 * cpu_us / ((double)transfer_time),
+        cpu_us * 1000.0 / nb_bytes);
+#ifdef BENCH_LOOPBACK_TSC_CYCLES
+    if (side->end_time > side->start_time) {
+        /* Cycles per microsecond of the time stamp counter over the measurement */
+        double ticks_per_us = ((double)(side->end_ticks - side->start_ticks)) / ((double)(side->end_time - side->start_time));
+        printf(" %10.2f\n", cpu_us * ticks_per_us / nb_bytes);
+    }
+    else
+#endif
+    {
+        printf(" %10s\n", "n/a");
+    }
+}
+
+static int bench_loopback_one(bench_loopback_param_t* param, int nb_cnx)
+{
+    int ret = 0;
+    char cert_file[512];
+    char key_file[512];
+    uint64_t current_time = picoquic_current_time();
+    picoquic_quic_t* qserver = NULL;
+    picoquic_quic_t* qclient = NULL;
+    picoquic_network_thread_ctx_t* server_thread = NULL;
+    picoquic_network_thread_ctx_t* client_thread = NULL;
+    picoquic_packet_loop_param_t server_loop_param;
+    picoquic_packet_loop_param_t client_loop_param;
+    bench_loopback_side_t server_side;
+    bench_loopback_side_t client_side;
+    struct sockaddr_storage server_addr;
+
+    memset(&server_side, 0, sizeof(server_side));
+    memset(&client_side, 0, sizeof(client_side));
+    server_side.param = param;
+    server_side.is_server = 1;
+    server_side.nb_cnx = nb_cnx;
+    server_side.volume_per_cnx = param->volume / nb_cnx;
+    client_side = server_side;
+    client_side.is_server = 0;
+
+    memset(&server_loop_param, 0, sizeof(server_loop_param));
+    server_loop_param.local_port = param->server_port;
+    server_loop_param.local_af = AF_INET;
+    server_loop_param.do_not_use_gso = param->do_not_use_gso;
+    server_loop_param.batch_depth = param->batch_depth;
+    server_loop_param.use_io_uring = param->use_io_uring;
+    server_loop_param.socket_buffer_size = param->socket_buffer_size;
+    client_loop_param = server_loop_param;
+    client_loop_param.local_port = 0;
+
+    if (picoquic_get_input_path(cert_file, sizeof(cert_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT) != 0 ||
+        picoquic_get_input_path(key_file, sizeof(key_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY) != 0 ||
+        picoquic_store_text_addr(&server_addr, "127.0.0.1", param->server_port) != 0) {
+        ret = -1;
+    }
+    else if ((qserver = picoquic_create(nb_cnx + 8, cert_file, key_file, NULL, BENCH_LOOPBACK_ALPN,
+        bench_loopback_callback, &server_side, NULL, NULL, NULL, current_time, NULL, NULL, NULL, 0)) == NULL ||
+        (qclient = picoquic_create(nb_cnx, NULL, NULL, NULL, BENCH_LOOPBACK_ALPN,
+        bench_loopback_callback, &client_side, NULL, NULL, NULL, current_time, NULL, NULL, NULL, 0)) == NULL) {
+        fprintf(stderr, "Cannot create the QUIC contexts, check the certificates in <%s>\n", cert_file);
+        ret = -1;
+    }
+    else if (picoquic_set_cipher_suite(qserver, param->cipher_suite_id) != 0 ||
+        picoquic_set_cipher_suite(qclient, param->cipher_suite_id) != 0) {
+        fprintf(stderr, "Cipher suite 0x%04x is not supported\n", param->cipher_suite_id);
+        ret = -1;
+    }
+    else {
+        picoquic_set_null_verifier(qclient);
+        server_thread = picoquic_start_network_thread(qserver, &server_loop_param, bench_loopback_loop_cb, &server_side, &ret);
+        if (server_thread == NULL && ret == 0) {
+            ret = -1;
+        }
+        while (ret == 0 && !server_thread->thread_is_ready && !server_thread->thread_is_closed) {
+            bench_loopback_sleep_msec(1);
+        }
+        if (ret == 0 && server_thread->thread_is_closed) {
+            fprintf(stderr, "Cannot start the server on port %d, error 0x%x\n", param->server_port, server_thread->return_code);
+            ret = -1;
+        }
+    }
+
+    /* The client connections are created before the client thread starts */
+    for (int i = 0; ret == 0 && i < nb_cnx; i++) {
+        uint8_t request = 'G';
+        picoquic_cnx_t* cnx = picoquic_create_cnx(qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&server_addr, current_time, 0, BENCH_LOOPBACK_SNI, BENCH_LOOPBACK_ALPN, 1);
+
+        if (cnx == NULL) {
+            ret = -1;
+        }
+        else if ((ret = picoquic_start_client_cnx(cnx)) == 0) {
+            ret = picoquic_add_to_stream(cnx, 0, &request, 1, 1);
+        }
+    }
+
+    if (ret == 0) {
+        client_thread = picoquic_start_network_thread(qclient, &client_loop_param, bench_loopback_loop_cb, &client_side, &ret);
+        if (client_thread == NULL && ret == 0) {
+            ret = -1;
+        }
+        while (ret == 0 && !client_thread->thread_is_closed) {
+            bench_loopback_sleep_msec(10);
+        }
+        if (ret == 0 && client_thread->return_code != 0 && client_thread->return_code != PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+            fprintf(stderr, "Client thread exit, ret = 0x%x\n", client_thread->return_code);
+            ret = client_thread->return_code;
+        }
+    }
+
+    if (server_thread != NULL) {
+        if (ret == 0 && (ret = picoquic_post_network_callback(server_thread, bench_loopback_server_measure, &server_side)) == 0) {
+            while (!server_side.is_measured && !server_thread->thread_is_closed) {
+                bench_loopback_sleep_msec(1);
+            }
+        }
+        picoquic_delete_network_thread(server_thread);
+    }
+    if (client_thread != NULL) {
+        picoquic_delete_network_thread(client_thread);
+    }
+
+    if (ret == 0 && (!client_side.is_measured || client_side.nb_bytes < server_side.volume_per_cnx * nb_cnx)) {
+        fprintf(stderr, "Transfer incomplete, %" PRIu64 " bytes received\n", client_side.nb_bytes);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        uint64_t transfer_time = (client_side.end_time > client_side.start_time) ?
+            client_side.end_time - client_side.start_time : 1;
+
+        printf("%7d %10.3f %10.3f\n", nb_cnx, ((double)transfer_time) / 1000000.0,
+            ((double)client_side.nb_bytes) * 8.0 / (((double)transfer_time) * 1000.0));
+        bench_loopback_print_side(&server_side, "server", transfer_time);
+        bench_loopback_print_side(&client_side, "client", transfer_time);
+        fflush(stdout);
+    }
+
+    if (qclient != NULL) {
+        picoquic_free(qclient);
+    }
+    if (qserver != NULL) {
+        picoquic_free(qserver);
+    }
+
+    return ret;
+}
+
+void bench_loopback_default_param(bench_loopback_param_t* param)
+{
+    memset(param, 0, sizeof(bench_loopback_param_t));
+    param->volume = 1000000000ull;
+    param->nb_cnx[0] = 1;
+    param->nb_cnx[1] = 16;
+    param->nb_cnx[2] = 256;
+    param->nb_runs = 3;
+    param->server_cpu = -1;
+    param->client_cpu = -1;
+    param->cipher_suite_id = PICOQUIC_AES_128_GCM_SHA256;
+    param->server_port = 4447;
+}
+
+int bench_loopback_parse_cnx_list(bench_loopback_param_t* param, char const* cnx_list)
+{
+    return bench_parse_cnx_list(cnx_list, param->nb_cnx, BENCH_LOOPBACK_MAX_RUNS, &param->nb_runs);
+}
+
+int bench_loopback(bench_loopback_param_t* param)
+{
+    int ret = 0;
+
+    printf("Loopback transfer of %.1f MB, cipher suite 0x%04x, GSO/GRO %s, batch depth %d%s, CPU server %d client %d\n",
+        ((double)param->volume) / 1000000.0, param->cipher_suite_id, (param->do_not_use_gso) ? "off" : "on",
+        param->batch_depth, (param->use_io_uring) ? ", io_uring" : "", param->server_cpu, param->client_cpu);
+    printf("%7s %10s %10s\n", "nb_cnx", "seconds", "Gbps");
+    printf("  %-7s %12s %12s %8s %10s %10s\n", "side", "pkt_sent/s", "pkt_recv/s", "cpu%", "cpu_ns/B", "cycles/B");
+
+    for (int i = 0; ret == 0 && i < param->nb_runs; i++) {
+        ret = bench_loopback_one(param, param->nb_cnx[i]);
+    }
+
+    return ret;
+}
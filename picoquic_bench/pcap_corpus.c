@@ -0,0 +1,862 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Frame corpus extracted from packet captures.
+*
+* The converter reads a capture in the classic pcap format, and a key log
+* file in the SSLKEYLOG format, as written by picoquic when the SSLKEYLOG
+* option is set. It decrypts the 1-RTT packets of the captured connections,
+* and writes a corpus of:
+* - the decrypted payloads of the 1-RTT packets, i.e., the frames as real
+*   peers send them, with real ACK range patterns and STREAM sizes,
+* - the QPACK header blocks found at the start of HTTP/3 request streams.
+*
+* The key log is indexed by the client random of the TLS handshake, which
+* would require decrypting the Initial packets to find. Instead, the
+* connections are identified by their connection IDs, learned from the long
+* header packets and from the NEW_CONNECTION_ID frames, and each new
+* connection ID is bound to a secret by trial decryption of its first short
+* header packet. Key updates are followed by rotating the secret when the
+* key phase changes.
+*
+* The corpus only keeps records that the picoquic parsers accept, so the
+* benchmarks can replay them without errors.
+*
+* The corpus file starts with the magic string "PQCORPUS". It is followed
+* by records, each encoded as a varint record type, a varint length and
+* the record content.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picohash.h"
+#include "tls_api.h"
+#include "h3zero.h"
+#include "picoquic_bench.h"
+
+#define BENCH_CORPUS_MAGIC "PQCORPUS"
+#define BENCH_CORPUS_MAGIC_LENGTH 8
+#define BENCH_CORPUS_SECRET_MAX 64
+#define BENCH_CORPUS_CAPTURE_MAX 0x40000
+#define BENCH_CORPUS_RANDOM_LENGTH 32
+
+/* Link types, as defined in the pcap format */
+#define BENCH_PCAP_LINKTYPE_NULL 0
+#define BENCH_PCAP_LINKTYPE_ETHERNET 1
+#define BENCH_PCAP_LINKTYPE_RAW_OPENBSD 12
+#define BENCH_PCAP_LINKTYPE_RAW 101
+#define BENCH_PCAP_LINKTYPE_LINUX_SLL 113
+#define BENCH_PCAP_LINKTYPE_LINUX_SLL2 276
+
+/* Secrets logged for one TLS session, indexed by the client random */
+typedef struct st_bench_corpus_keys_t {
+    struct st_bench_corpus_keys_t* next;
+    uint8_t client_random[BENCH_CORPUS_RANDOM_LENGTH];
+    uint8_t secret[2][BENCH_CORPUS_SECRET_MAX]; /* 0: client, 1: server */
+    size_t secret_length[2];
+} bench_corpus_keys_t;
+
+/* Decryption state of the packets sent by one side of a session */
+typedef struct st_bench_corpus_sender_t {
+    struct st_bench_corpus_sender_t* next;
+    bench_corpus_keys_t* keys;
+    int side;
+    int cipher_suite_id;
+    int version_index;
+    uint8_t secret[BENCH_CORPUS_SECRET_MAX]; /* secret of the current key phase */
+    int key_phase;
+    picoquic_crypto_context_t crypto;
+    uint64_t highest_pn;
+} bench_corpus_sender_t;
+
+/* Connection ID learned from the capture. The sender is set once a
+ * packet sent to that connection ID is decrypted. */
+typedef struct st_bench_corpus_cid_t {
+    picohash_item hash_item;
+    picoquic_connection_id_t cid;
+    int version_index;
+    bench_corpus_sender_t* sender;
+} bench_corpus_cid_t;
+
+typedef struct st_bench_corpus_ctx_t {
+    bench_corpus_keys_t* keys;
+    bench_corpus_sender_t* senders;
+    picohash_table* cid_table;
+    uint8_t hash_seed[16];
+    int cid_length_seen[PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
+    FILE* F_out;
+    uint64_t nb_datagrams;
+    uint64_t nb_short_packets;
+    uint64_t nb_unknown_cid;
+    uint64_t nb_not_decrypted;
+    uint64_t nb_not_parsed;
+    uint64_t nb_frames_records;
+    uint64_t nb_header_records;
+    uint64_t nb_ack_frames;
+    uint64_t nb_stream_frames;
+    uint64_t nb_other_frames;
+    uint8_t decrypted[BENCH_CORPUS_CAPTURE_MAX];
+} bench_corpus_ctx_t;
+
+static uint64_t bench_corpus_cid_hash(const void* key, const uint8_t* hash_seed)
+{
+    const bench_corpus_cid_t* cid_entry = (const bench_corpus_cid_t*)key;
+
+    return picohash_bytes(cid_entry->cid.id, cid_entry->cid.id_len, hash_seed);
+}
+
+static int bench_corpus_cid_compare(const void* key1, const void* key2)
+{
+    const bench_corpus_cid_t* cid1 = (const bench_corpus_cid_t*)key1;
+    const bench_corpus_cid_t* cid2 = (const bench_corpus_cid_t*)key2;
+
+    return picoquic_compare_connection_id(&cid1->cid, &cid2->cid);
+}
+
+static picohash_item* bench_corpus_cid_to_item(const void* key)
+{
+    bench_corpus_cid_t* cid_entry = (bench_corpus_cid_t*)key;
+
+    return &cid_entry->hash_item;
+}
+
+static bench_corpus_cid_t* bench_corpus_find_cid(bench_corpus_ctx_t* ctx, const picoquic_connection_id_t* cid)
+{
+    bench_corpus_cid_t key;
+    picohash_item* item;
+
+    memset(&key, 0, sizeof(key));
+    key.cid = *cid;
+    item = picohash_retrieve(ctx->cid_table, &key);
+
+    return (item == NULL) ? NULL : (bench_corpus_cid_t*)item->key;
+}
+
+static void bench_corpus_learn_cid(bench_corpus_ctx_t* ctx, const picoquic_connection_id_t* cid, int version_index)
+{
+    if (cid->id_len > 0 && bench_corpus_find_cid(ctx, cid) == NULL) {
+        bench_corpus_cid_t* cid_entry = (bench_corpus_cid_t*)malloc(sizeof(bench_corpus_cid_t));
+
+        if (cid_entry != NULL) {
+            memset(cid_entry, 0, sizeof(bench_corpus_cid_t));
+            cid_entry->cid = *cid;
+            cid_entry->version_index = version_index;
+            if (picohash_insert(ctx->cid_table, cid_entry) != 0) {
+                free(cid_entry);
+            }
+            else {
+                ctx->cid_length_seen[cid->id_len] = 1;
+            }
+        }
+    }
+}
+
+/* Key log parsing. Only the application traffic secrets are kept. */
+static int bench_corpus_parse_hex(char const* hex, uint8_t* bin, size_t bin_max, size_t* bin_length)
+{
+    size_t hex_length = strlen(hex);
+
+    *bin_length = 0;
+    if (hex_length % 2 != 0 || hex_length / 2 > bin_max) {
+        return -1;
+    }
+    *bin_length = picoquic_parse_hexa(hex, hex_length, bin, bin_max);
+
+    return (*bin_length == hex_length / 2) ? 0 : -1;
+}
+
+static int bench_corpus_read_keylog(bench_corpus_ctx_t* ctx, char const* keylog_file)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(keylog_file, "r");
+    char line[512];
+
+    if (F == NULL) {
+        fprintf(stderr, "Cannot open key log file: %s\n", keylog_file);
+        ret = -1;
+    }
+
+    while (ret == 0 && fgets(line, sizeof(line), F) != NULL) {
+        char label[64];
+        char random_hex[2 * BENCH_CORPUS_RANDOM_LENGTH + 1];
+        char secret_hex[2 * BENCH_CORPUS_SECRET_MAX + 1];
+        uint8_t client_random[BENCH_CORPUS_RANDOM_LENGTH];
+        uint8_t secret[BENCH_CORPUS_SECRET_MAX];
+        size_t random_length;
+        size_t secret_length;
+        int side;
+
+        if (sscanf(line, "%63s %64s %128s", label, random_hex, secret_hex) != 3) {
+            continue;
+        }
+        if (strcmp(label, "CLIENT_TRAFFIC_SECRET_0") == 0) {
+            side = 0;
+        }
+        else if (strcmp(label, "SERVER_TRAFFIC_SECRET_0") == 0) {
+            side = 1;
+        }
+        else {
+            continue;
+        }
+        if (bench_corpus_parse_hex(random_hex, client_random, sizeof(client_random), &random_length) != 0 ||
+            random_length != BENCH_CORPUS_RANDOM_LENGTH ||
+            bench_corpus_parse_hex(secret_hex, secret, sizeof(secret), &secret_length) != 0) {
+            DBG_PRINTF("Ignoring key log line: %s", line);
+        }
+        else {
+            bench_corpus_keys_t* keys = ctx->keys;
+
+            while (keys != NULL && memcmp(keys->client_random, client_random, BENCH_CORPUS_RANDOM_LENGTH) != 0) {
+                keys = keys->next;
+            }
+            if (keys == NULL) {
+                keys = (bench_corpus_keys_t*)malloc(sizeof(bench_corpus_keys_t));
+                if (keys == NULL) {
+                    ret = PICOQUIC_ERROR_MEMORY;
+                    break;
+                }
+                memset(keys, 0, sizeof(bench_corpus_keys_t));
+                memcpy(keys->client_random, client_random, BENCH_CORPUS_RANDOM_LENGTH);
+                keys->next = ctx->keys;
+                ctx->keys = keys;
+            }
+            memcpy(keys->secret[side], secret, secret_length);
+            keys->secret_length[side] = secret_length;
+        }
+    }
+
+    (void)picoquic_file_close(F);
+
+    return ret;
+}
+
+/* Attempt to decrypt a short header packet with a sender's keys. On success,
+ * the clear text header and payload are in decrypted, and the sender state
+ * is updated with the packet number and the key phase. */
+static int bench_corpus_decrypt(bench_corpus_sender_t* sender, uint8_t* bytes, size_t length, uint8_t cid_length,
+    uint8_t* decrypted, size_t* header_length, size_t* payload_length)
+{
+    int ret = -1;
+    picoquic_packet_header ph;
+
+    memset(&ph, 0, sizeof(ph));
+    ph.ptype = picoquic_packet_1rtt_protected;
+    ph.epoch = picoquic_epoch_1rtt;
+    ph.offset = 1 + (size_t)cid_length;
+    ph.pn_offset = ph.offset;
+    ph.payload_length = (uint16_t)(length - ph.offset);
+
+    if (picoquic_remove_header_protection_inner(bytes, length, decrypted, &ph, sender->crypto.pn_dec, 0,
+        sender->highest_pn) == 0 && ph.pn64 != UINT64_MAX && ph.offset < length) {
+        void* aead_ctx = sender->crypto.aead_decrypt;
+        picoquic_crypto_context_t next_crypto;
+        uint8_t next_secret[BENCH_CORPUS_SECRET_MAX];
+        size_t secret_length = sender->keys->secret_length[sender->side];
+        size_t decoded;
+
+        memset(&next_crypto, 0, sizeof(next_crypto));
+        if ((int)ph.key_phase != sender->key_phase) {
+            /* Try the keys of the next phase */
+            memcpy(next_secret, sender->secret, secret_length);
+            if (picoquic_rotate_secret_by_id(sender->cipher_suite_id, sender->version_index, next_secret, secret_length) != 0 ||
+                picoquic_set_crypto_context_from_secret(&next_crypto, sender->cipher_suite_id, sender->version_index, 0, 1,
+                    next_secret, secret_length) != 0) {
+                aead_ctx = NULL;
+            }
+            else {
+                aead_ctx = next_crypto.aead_decrypt;
+            }
+        }
+
+        decoded = picoquic_aead_decrypt_generic(decrypted + ph.offset, bytes + ph.offset, ph.payload_length,
+            ph.pn64, decrypted, ph.offset, aead_ctx);
+        if (decoded <= ph.payload_length) {
+            ret = 0;
+            *header_length = ph.offset;
+            *payload_length = decoded;
+            if (ph.pn64 > sender->highest_pn) {
+                sender->highest_pn = ph.pn64;
+            }
+            if (aead_ctx != NULL && aead_ctx == next_crypto.aead_decrypt) {
+                picoquic_aead_free(sender->crypto.aead_decrypt);
+                sender->crypto.aead_decrypt = next_crypto.aead_decrypt;
+                next_crypto.aead_decrypt = NULL;
+                memcpy(sender->secret, next_secret, secret_length);
+                sender->key_phase = ph.key_phase;
+            }
+        }
+        picoquic_crypto_context_free(&next_crypto);
+    }
+
+    return ret;
+}
+
+static void bench_corpus_sender_free(bench_corpus_sender_t* sender)
+{
+    picoquic_crypto_context_free(&sender->crypto);
+    free(sender);
+}
+
+/* Find the sender of a short header packet addressed to an unbound
+ * connection ID, by trying the known senders, then the unused secrets. */
+static bench_corpus_sender_t* bench_corpus_bind_sender(bench_corpus_ctx_t* ctx, bench_corpus_cid_t* cid_entry,
+    uint8_t* bytes, size_t length, uint8_t* decrypted, size_t* header_length, size_t* payload_length)
+{
+    bench_corpus_sender_t* sender = ctx->senders;
+
+    while (sender != NULL) {
+        if (bench_corpus_decrypt(sender, bytes, length, cid_entry->cid.id_len, decrypted, header_length, payload_length) == 0) {
+            break;
+        }
+        sender = sender->next;
+    }
+
+    for (bench_corpus_keys_t* keys = ctx->keys; sender == NULL && keys != NULL; keys = keys->next) {
+        for (int side = 0; sender == NULL && side < 2; side++) {
+            static const int suites_sha256[] = { PICOQUIC_AES_128_GCM_SHA256, PICOQUIC_CHACHA20_POLY1305_SHA256 };
+            static const int suites_sha384[] = { PICOQUIC_AES_256_GCM_SHA384 };
+            const int* suites = (keys->secret_length[side] == 48) ? suites_sha384 : suites_sha256;
+            size_t nb_suites = (keys->secret_length[side] == 48) ? 1 : 2;
+            bench_corpus_sender_t* known = ctx->senders;
+
+            while (known != NULL && (known->keys != keys || known->side != side)) {
+                known = known->next;
+            }
+            if (known != NULL || keys->secret_length[side] == 0) {
+                continue;
+            }
+
+            for (size_t i = 0; sender == NULL && i < nb_suites; i++) {
+                bench_corpus_sender_t* candidate = (bench_corpus_sender_t*)malloc(sizeof(bench_corpus_sender_t));
+
+                if (candidate == NULL) {
+                    break;
+                }
+                memset(candidate, 0, sizeof(bench_corpus_sender_t));
+                candidate->keys = keys;
+                candidate->side = side;
+                candidate->cipher_suite_id = suites[i];
+                candidate->version_index = cid_entry->version_index;
+                memcpy(candidate->secret, keys->secret[side], keys->secret_length[side]);
+                if (picoquic_set_crypto_context_from_secret(&candidate->crypto, candidate->cipher_suite_id,
+                    candidate->version_index, 0, 0, candidate->secret, keys->secret_length[side]) == 0 &&
+                    bench_corpus_decrypt(candidate, bytes, length, cid_entry->cid.id_len, decrypted, header_length, payload_length) == 0) {
+                    candidate->next = ctx->senders;
+                    ctx->senders = candidate;
+                    sender = candidate;
+                }
+                else {
+                    bench_corpus_sender_free(candidate);
+                }
+            }
+        }
+    }
+
+    return sender;
+}
+
+static int bench_corpus_write_record(bench_corpus_ctx_t* ctx, uint64_t record_type, const uint8_t* data, size_t length)
+{
+    uint8_t header[16];
+    uint8_t* bytes = header;
+    int ret = 0;
+
+    if ((bytes = picoquic_frames_varint_encode(bytes, header + sizeof(header), record_type)) == NULL ||
+        (bytes = picoquic_frames_varint_encode(bytes, header + sizeof(header), length)) == NULL ||
+        fwrite(header, 1, bytes - header, ctx->F_out) != (size_t)(bytes - header) ||
+        fwrite(data, 1, length, ctx->F_out) != length) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Check that the frames can be parsed, count them, learn the new
+ * connection IDs, and extract the QPACK header blocks of the HEADERS
+ * frames found at the beginning of bidirectional streams. */
+static int bench_corpus_process_frames(bench_corpus_ctx_t* ctx, bench_corpus_sender_t* sender, uint8_t* bytes, size_t length)
+{
+    int ret = 0;
+    size_t byte_index = 0;
+    uint64_t nb_ack = 0;
+    uint64_t nb_stream = 0;
+    uint64_t nb_other = 0;
+
+    while (ret == 0 && byte_index < length) {
+        uint8_t* frame = bytes + byte_index;
+        size_t consumed = 0;
+        int pure_ack = 0;
+
+        if ((ret = picoquic_skip_frame(frame, length - byte_index, &consumed, &pure_ack)) != 0) {
+            break;
+        }
+        if (frame[0] == picoquic_frame_type_ack || frame[0] == picoquic_frame_type_ack_ecn) {
+            nb_ack++;
+        }
+        else if (frame[0] >= picoquic_frame_type_stream_range_min && frame[0] <= picoquic_frame_type_stream_range_max) {
+            uint64_t stream_id;
+            uint64_t offset;
+            size_t data_length;
+            int fin;
+            size_t header_length;
+
+            nb_stream++;
+            if (picoquic_parse_stream_header(frame, consumed, &stream_id, &offset, &data_length, &fin, &header_length) == 0 &&
+                offset == 0 && PICOQUIC_IS_BIDIR_STREAM_ID(stream_id) && data_length > 0) {
+                const uint8_t* h3_bytes = frame + header_length;
+                const uint8_t* h3_max = h3_bytes + data_length;
+                uint64_t h3_type = 0;
+                size_t h3_length = 0;
+
+                if ((h3_bytes = picoquic_frames_varint_decode(h3_bytes, h3_max, &h3_type)) != NULL &&
+                    (h3_bytes = picoquic_frames_varlen_decode(h3_bytes, h3_max, &h3_length)) != NULL &&
+                    h3_type == h3zero_frame_header && h3_length <= (size_t)(h3_max - h3_bytes)) {
+                    h3zero_header_parts_t parts;
+                    uint8_t* block = (uint8_t*)h3_bytes;
+
+                    memset(&parts, 0, sizeof(parts));
+                    if (h3zero_parse_qpack_header_frame(block, block + h3_length, &parts) == block + h3_length) {
+                        ret = bench_corpus_write_record(ctx, BENCH_CORPUS_RECORD_HEADERS, block, h3_length);
+                        ctx->nb_header_records++;
+                    }
+                    h3zero_release_header_parts(&parts);
+                }
+            }
+        }
+        else {
+            nb_other++;
+            if (frame[0] == picoquic_frame_type_new_connection_id) {
+                const uint8_t* cid_bytes = frame + 1;
+                const uint8_t* cid_max = frame + consumed;
+                picoquic_connection_id_t cid;
+
+                if ((cid_bytes = picoquic_frames_varint_skip(cid_bytes, cid_max)) != NULL &&
+                    (cid_bytes = picoquic_frames_varint_skip(cid_bytes, cid_max)) != NULL &&
+                    (cid_bytes = picoquic_frames_cid_decode(cid_bytes, cid_max, &cid)) != NULL) {
+                    bench_corpus_learn_cid(ctx, &cid, sender->version_index);
+                }
+            }
+        }
+        byte_index += consumed;
+    }
+
+    if (ret != 0) {
+        /* Only keep the packets that the parser accepts */
+        ctx->nb_not_parsed++;
+        ret = 0;
+    }
+    else {
+        ctx->nb_ack_frames += nb_ack;
+        ctx->nb_stream_frames += nb_stream;
+        ctx->nb_other_frames += nb_other;
+        ret = bench_corpus_write_record(ctx, BENCH_CORPUS_RECORD_FRAMES, bytes, length);
+        ctx->nb_frames_records++;
+    }
+
+    return ret;
+}
+
+static int bench_corpus_process_short(bench_corpus_ctx_t* ctx, uint8_t* bytes, size_t length)
+{
+    int ret = 0;
+    bench_corpus_cid_t* cid_entry = NULL;
+    uint8_t* decrypted = ctx->decrypted;
+    size_t header_length = 0;
+    size_t payload_length = 0;
+
+    ctx->nb_short_packets++;
+    /* Prefer the longest match, in case a short CID is the prefix of a longer one */
+    for (int cid_length = PICOQUIC_CONNECTION_ID_MAX_SIZE; cid_entry == NULL && cid_length > 0; cid_length--) {
+        if (ctx->cid_length_seen[cid_length] && (size_t)cid_length + 1 < length) {
+            picoquic_connection_id_t cid;
+
+            (void)picoquic_parse_connection_id(bytes + 1, (uint8_t)cid_length, &cid);
+            cid_entry = bench_corpus_find_cid(ctx, &cid);
+        }
+    }
+
+    if (cid_entry == NULL) {
+        ctx->nb_unknown_cid++;
+    }
+    else {
+        bench_corpus_sender_t* sender = cid_entry->sender;
+
+        if (sender != NULL) {
+            if (bench_corpus_decrypt(sender, bytes, length, cid_entry->cid.id_len, decrypted, &header_length, &payload_length) != 0) {
+                sender = NULL;
+            }
+        }
+        else if ((sender = bench_corpus_bind_sender(ctx, cid_entry, bytes, length, decrypted,
+            &header_length, &payload_length)) != NULL) {
+            cid_entry->sender = sender;
+        }
+
+        if (sender == NULL) {
+            ctx->nb_not_decrypted++;
+        }
+        else {
+            ret = bench_corpus_process_frames(ctx, sender, decrypted + header_length, payload_length);
+        }
+    }
+
+    return ret;
+}
+
+/* Process the QUIC packets coalesced in a UDP datagram. The connection IDs
+ * of the long header packets are learned, and short header packets, which
+ * are always last, are decrypted. */
+static int bench_corpus_process_datagram(bench_corpus_ctx_t* ctx, uint8_t* bytes, size_t length)
+{
+    int ret = 0;
+    size_t byte_index = 0;
+
+    ctx->nb_datagrams++;
+    while (ret == 0 && byte_index < length) {
+        uint8_t* packet = bytes + byte_index;
+        const uint8_t* packet_max = bytes + length;
+
+        if ((packet[0] & 0x80) == 0) {
+            if ((packet[0] & 0x40) != 0) {
+                ret = bench_corpus_process_short(ctx, packet, length - byte_index);
+            }
+            break;
+        }
+        else {
+            const uint8_t* next = packet + 1;
+            uint32_t version = 0;
+            int version_index;
+            picoquic_connection_id_t dcid;
+            picoquic_connection_id_t scid;
+            picoquic_packet_type_enum ptype;
+            size_t payload_length = 0;
+
+            if ((next = picoquic_frames_uint32_decode(next, packet_max, &version)) == NULL || version == 0 ||
+                (version_index = picoquic_get_version_index(version)) < 0 ||
+                (next = picoquic_frames_cid_decode(next, packet_max, &dcid)) == NULL ||
+                (next = picoquic_frames_cid_decode(next, packet_max, &scid)) == NULL) {
+                break;
+            }
+            bench_corpus_learn_cid(ctx, &dcid, version_index);
+            bench_corpus_learn_cid(ctx, &scid, version_index);
+            ptype = picoquic_parse_long_packet_type(packet[0], version_index);
+            if (ptype == picoquic_packet_initial) {
+                next = picoquic_frames_length_data_skip(next, packet_max);
+            }
+            else if (ptype != picoquic_packet_handshake && ptype != picoquic_packet_0rtt_protected) {
+                /* Retry, or unknown type: nothing else in the datagram */
+                break;
+            }
+            if (next == NULL || (next = picoquic_frames_varlen_decode(next, packet_max, &payload_length)) == NULL ||
+                payload_length > (size_t)(packet_max - next)) {
+                break;
+            }
+            byte_index = (next + payload_length) - bytes;
+        }
+    }
+
+    return ret;
+}
+
+/* Locate the UDP payload in a captured frame */
+static int bench_corpus_get_udp_payload(uint32_t link_type, uint8_t* bytes, size_t length,
+    uint8_t** payload, size_t* payload_length)
+{
+    size_t offset = 0;
+    int ip_version = 0;
+    int ret = -1;
+
+    switch (link_type) {
+    case BENCH_PCAP_LINKTYPE_NULL:
+        offset = 4;
+        break;
+    case BENCH_PCAP_LINKTYPE_ETHERNET:
+        offset = 12;
+        while (offset + 2 <= length && PICOPARSE_16(bytes + offset) == 0x8100) {
+            /* VLAN tags */
+            offset += 4;
+        }
+        offset += 2;
+        break;
+    case BENCH_PCAP_LINKTYPE_RAW:
+    case BENCH_PCAP_LINKTYPE_RAW_OPENBSD:
+        break;
+    case BENCH_PCAP_LINKTYPE_LINUX_SLL:
+        offset = 16;
+        break;
+    case BENCH_PCAP_LINKTYPE_LINUX_SLL2:
+        offset = 20;
+        break;
+    default:
+        offset = length;
+        break;
+    }
+
+    if (offset < length) {
+        ip_version = bytes[offset] >> 4;
+    }
+
+    if (ip_version == 4 && offset + 20 <= length) {
+        size_t header_length = 4 * (size_t)(bytes[offset] & 0x0f);
+        size_t total_length = PICOPARSE_16(bytes + offset + 2);
+
+        /* Fragments are ignored */
+        if (bytes[offset + 9] == 17 && (PICOPARSE_16(bytes + offset + 6) & 0x3fff) == 0 &&
+            header_length >= 20 && total_length >= header_length && offset + total_length <= length) {
+            length = offset + total_length;
+            offset += header_length;
+            ret = 0;
+        }
+    }
+    else if (ip_version == 6 && offset + 40 <= length) {
+        size_t total_length = 40 + (size_t)PICOPARSE_16(bytes + offset + 4);
+
+        /* Extension headers are not supported */
+        if (bytes[offset + 6] == 17 && offset + total_length <= length) {
+            length = offset + total_length;
+            offset += 40;
+            ret = 0;
+        }
+    }
+
+    if (ret == 0) {
+        size_t udp_length;
+
+        if (offset + 8 > length || (udp_length = PICOPARSE_16(bytes + offset + 4)) < 8 ||
+            offset + udp_length > length) {
+            ret = -1;
+        }
+        else {
+            *payload = bytes + offset + 8;
+            *payload_length = udp_length - 8;
+        }
+    }
+
+    return ret;
+}
+
+static uint32_t bench_pcap_uint32(const uint8_t* bytes, int is_swapped)
+{
+    return (is_swapped) ? PICOPARSE_32(bytes) :
+        ((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+}
+
+static int bench_corpus_read_pcap(bench_corpus_ctx_t* ctx, char const* pcap_file)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(pcap_file, "rb");
+    uint8_t header[24];
+    uint8_t* buffer = (uint8_t*)malloc(BENCH_CORPUS_CAPTURE_MAX);
+    int is_swapped = 0;
+    uint32_t link_type = 0;
+
+    if (F == NULL || buffer == NULL) {
+        fprintf(stderr, "Cannot open capture file: %s\n", pcap_file);
+        ret = -1;
+    }
+    else if (fread(header, 1, sizeof(header), F) != sizeof(header)) {
+        ret = -1;
+    }
+    else {
+        /* The magic number tells the byte order, and whether time stamps are
+         * in microseconds or nanoseconds, which does not matter here. */
+        uint32_t magic = PICOPARSE_32(header);
+
+        if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+            is_swapped = 1;
+        }
+        else if (magic != 0xd4c3b2a1 && magic != 0x4d3cb2a1) {
+            ret = -1;
+        }
+        link_type = bench_pcap_uint32(header + 20, is_swapped) & 0xffff;
+    }
+
+    if (ret != 0 && F != NULL) {
+        fprintf(stderr, "Not a pcap file: %s (pcapng is not supported)\n", pcap_file);
+    }
+
+    while (ret == 0) {
+        uint8_t record_header[16];
+        uint32_t captured_length;
+        uint8_t* payload = NULL;
+        size_t payload_length = 0;
+
+        if (fread(record_header, 1, sizeof(record_header), F) != sizeof(record_header)) {
+            break;
+        }
+        captured_length = bench_pcap_uint32(record_header + 8, is_swapped);
+        if (captured_length > BENCH_CORPUS_CAPTURE_MAX ||
+            fread(buffer, 1, captured_length, F) != captured_length) {
+            fprintf(stderr, "Truncated capture file: %s\n", pcap_file);
+            ret = -1;
+        }
+        else if (bench_corpus_get_udp_payload(link_type, buffer, captured_length, &payload, &payload_length) == 0 &&
+            payload_length > 0) {
+            ret = bench_corpus_process_datagram(ctx, payload, payload_length);
+        }
+    }
+
+    (void)picoquic_file_close(F);
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return ret;
+}
+
+int bench_corpus_from_pcap(char const* pcap_file, char const* keylog_file, char const* corpus_file)
+{
+    int ret = 0;
+    bench_corpus_ctx_t* ctx = (bench_corpus_ctx_t*)malloc(sizeof(bench_corpus_ctx_t));
+
+    if (ctx == NULL) {
+        return PICOQUIC_ERROR_MEMORY;
+    }
+    memset(ctx, 0, sizeof(bench_corpus_ctx_t));
+    picoquic_public_random(ctx->hash_seed, sizeof(ctx->hash_seed));
+
+    if ((ctx->cid_table = picohash_create_ex(1024, bench_corpus_cid_hash, bench_corpus_cid_compare,
+        bench_corpus_cid_to_item, ctx->hash_seed)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((ret = bench_corpus_read_keylog(ctx, keylog_file)) == 0) {
+        if ((ctx->F_out = picoquic_file_open(corpus_file, "wb")) == NULL) {
+            fprintf(stderr, "Cannot create corpus file: %s\n", corpus_file);
+            ret = -1;
+        }
+        else if (fwrite(BENCH_CORPUS_MAGIC, 1, BENCH_CORPUS_MAGIC_LENGTH, ctx->F_out) != BENCH_CORPUS_MAGIC_LENGTH) {
+            ret = -1;
+        }
+        else {
+            ret = bench_corpus_read_pcap(ctx, pcap_file);
+        }
+        ctx->F_out = picoquic_file_close(ctx->F_out);
+    }
+
+    printf("Read %" PRIu64 " datagrams, %" PRIu64 " short header packets.\n", ctx->nb_datagrams, ctx->nb_short_packets);
+    printf("Packets with unknown CID: %" PRIu64 ", not decrypted: %" PRIu64 ", not parsed: %" PRIu64 ".\n",
+        ctx->nb_unknown_cid, ctx->nb_not_decrypted, ctx->nb_not_parsed);
+    printf("Wrote %" PRIu64 " frame records (%" PRIu64 " ACK, %" PRIu64 " STREAM, %" PRIu64 " other frames), %" PRIu64 " header blocks.\n",
+        ctx->nb_frames_records, ctx->nb_ack_frames, ctx->nb_stream_frames, ctx->nb_other_frames, ctx->nb_header_records);
+    if (ret == 0 && ctx->nb_frames_records == 0) {
+        fprintf(stderr, "No packet could be decrypted, check the key log file.\n");
+        ret = -1;
+    }
+
+    if (ctx->cid_table != NULL) {
+        picohash_delete(ctx->cid_table, 1);
+    }
+    while (ctx->senders != NULL) {
+        bench_corpus_sender_t* sender = ctx->senders;
+        ctx->senders = sender->next;
+        bench_corpus_sender_free(sender);
+    }
+    while (ctx->keys != NULL) {
+        bench_corpus_keys_t* keys = ctx->keys;
+        ctx->keys = keys->next;
+        free(keys);
+    }
+    free(ctx);
+
+    return ret;
+}
+
+int bench_corpus_load(char const* corpus_file, bench_corpus_t* corpus)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(corpus_file, "rb");
+    long file_length = 0;
+
+    memset(corpus, 0, sizeof(bench_corpus_t));
+    if (F == NULL || fseek(F, 0, SEEK_END) != 0 || (file_length = ftell(F)) < BENCH_CORPUS_MAGIC_LENGTH ||
+        fseek(F, 0, SEEK_SET) != 0) {
+        ret = -1;
+    }
+    else if ((corpus->buffer = (uint8_t*)malloc((size_t)file_length)) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if (fread(corpus->buffer, 1, (size_t)file_length, F) != (size_t)file_length ||
+        memcmp(corpus->buffer, BENCH_CORPUS_MAGIC, BENCH_CORPUS_MAGIC_LENGTH) != 0) {
+        ret = -1;
+    }
+    else {
+        const uint8_t* bytes_max = corpus->buffer + file_length;
+
+        /* Two passes: count the records, then set them. */
+        for (int pass = 0; ret == 0 && pass < 2; pass++) {
+            const uint8_t* bytes = corpus->buffer + BENCH_CORPUS_MAGIC_LENGTH;
+            size_t nb_records = 0;
+
+            while (ret == 0 && bytes < bytes_max) {
+                uint64_t record_type = 0;
+                size_t length = 0;
+
+                if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &record_type)) == NULL ||
+                    (bytes = picoquic_frames_varlen_decode(bytes, bytes_max, &length)) == NULL ||
+                    length > (size_t)(bytes_max - bytes)) {
+                    ret = -1;
+                    break;
+                }
+                if (pass == 1) {
+                    corpus->records[nb_records].record_type = record_type;
+                    corpus->records[nb_records].data = bytes;
+                    corpus->records[nb_records].length = length;
+                }
+                nb_records++;
+                bytes += length;
+            }
+
+            if (ret == 0 && pass == 0) {
+                if (nb_records == 0) {
+                    ret = -1;
+                }
+                else if ((corpus->records = (bench_corpus_record_t*)malloc(nb_records * sizeof(bench_corpus_record_t))) == NULL) {
+                    ret = PICOQUIC_ERROR_MEMORY;
+                }
+                else {
+                    corpus->nb_records = nb_records;
+                }
+            }
+        }
+    }
+
+    (void)picoquic_file_close(F);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot load the corpus file: %s\n", corpus_file);
+        bench_corpus_release(corpus);
+    }
+
+    return ret;
+}
+
+void bench_corpus_release(bench_corpus_t* corpus)
+{
+    if (corpus->records != NULL) {
+        free(corpus->records);
+    }
+    if (corpus->buffer != NULL) {
+        free(corpus->buffer);
+    }
+    memset(corpus, 0, sizeof(bench_corpus_t));
+}
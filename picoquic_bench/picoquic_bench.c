@@ -0,0 +1,1601 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Microbenchmarks of the core hot paths.
+*
+* Each benchmark prepares its state, then runs an operation in a loop. The
+* number of iterations is calibrated so that a run lasts about the target
+* duration, and the run is repeated several times. The program reports the
+* median duration per operation, and the number of memory allocations per
+* operation. Allocations are counted by wrapping malloc, calloc, realloc and free
+* at link time, which is only supported on Linux; on other platforms the
+* allocation count reports "n/a".
+*
+* The benchmarks that need a connection use the simulated network of the
+* test library, which requires the certificates of the solution directory
+* (option -S). The setup steps that are not part of the measured path, such
+* as delivering packets to the peer, are excluded from both the duration and
+* the allocation count by calling bench_pause() and bench_resume().
+*/
+
+#ifdef _WINDOWS
+#include "getopt.h"
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef PICOQUIC_BENCH_COUNT_ALLOC
+#include <malloc.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picohash.h"
+#include "picosplay.h"
+#include "tls_api.h"
+#include "picoquictest_internal.h"
+#include "h3zero.h"
+#include "picoquic_bench.h"
+
+void picoquic_tls_api_unload();
+
+#define BENCH_NB_RUNS 5
+#define BENCH_NB_RUNS_QUICK 3
+#define BENCH_TARGET_NS 200000000ull
+#define BENCH_TARGET_NS_QUICK 20000000ull
+#define BENCH_NB_TABLE_ENTRIES 4096
+#define BENCH_AEAD_LENGTH 1200
+#define BENCH_AEAD_HEADER_LENGTH 20
+#define BENCH_STREAM_FRAME_LENGTH 1000
+
+typedef int (*bench_op_fn)(void* op_ctx, uint64_t nb_ops);
+
+typedef struct st_bench_ctx_t {
+    char const** filters;
+    int nb_filters;
+    int nb_runs;
+    uint64_t target_ns;
+    size_t nb_benchmarks;
+    bench_corpus_t* corpus; /* NULL if no corpus file */
+    /* Measurement state */
+    uint64_t nb_allocs;
+    int64_t nb_alloc_bytes;
+    uint64_t paused_ns;
+    uint64_t pause_start;
+    int is_paused;
+} bench_ctx_t;
+
+static bench_ctx_t bench_ctx;
+
+uint64_t bench_time_ns()
+{
+#ifdef _WINDOWS
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec) * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifdef PICOQUIC_BENCH_COUNT_ALLOC
+/* The byte count is the net amount of memory allocated while counting,
+ * using the usable size of each block, so it includes the allocator padding. */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size)
+{
+    void* ptr = __real_malloc(size);
+
+    if (!bench_ctx.is_paused) {
+        bench_ctx.nb_allocs++;
+        if (ptr != NULL) {
+            bench_ctx.nb_alloc_bytes += (int64_t)malloc_usable_size(ptr);
+        }
+    }
+    return ptr;
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    void* ptr = __real_calloc(nmemb, size);
+
+    if (!bench_ctx.is_paused) {
+        bench_ctx.nb_allocs++;
+        if (ptr != NULL) {
+            bench_ctx.nb_alloc_bytes += (int64_t)malloc_usable_size(ptr);
+        }
+    }
+    return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    size_t old_size = (ptr == NULL || bench_ctx.is_paused) ? 0 : malloc_usable_size(ptr);
+    void* new_ptr = __real_realloc(ptr, size);
+
+    if (!bench_ctx.is_paused) {
+        bench_ctx.nb_allocs++;
+        if (new_ptr != NULL) {
+            bench_ctx.nb_alloc_bytes += (int64_t)malloc_usable_size(new_ptr) - (int64_t)old_size;
+        }
+    }
+    return new_ptr;
+}
+
+void __wrap_free(void* ptr)
+{
+    if (!bench_ctx.is_paused && ptr != NULL) {
+        bench_ctx.nb_alloc_bytes -= (int64_t)malloc_usable_size(ptr);
+    }
+    __real_free(ptr);
+}
+#endif
+
+int bench_alloc_is_counted()
+{
+#ifdef PICOQUIC_BENCH_COUNT_ALLOC
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void bench_alloc_reset()
+{
+    bench_ctx.nb_allocs = 0;
+    bench_ctx.nb_alloc_bytes = 0;
+}
+
+void bench_alloc_set_counting(int is_counting)
+{
+    bench_ctx.is_paused = !is_counting;
+}
+
+void bench_alloc_get(uint64_t* nb_allocs, int64_t* nb_bytes)
+{
+    *nb_allocs = bench_ctx.nb_allocs;
+    *nb_bytes = bench_ctx.nb_alloc_bytes;
+}
+
+/* List of connection counts, separated by commas, e.g. "1,16,256" */
+int bench_parse_cnx_list(char const* cnx_list, int* nb_cnx, int nb_max, int* nb_values)
+{
+    int ret = 0;
+    int nb_runs = 0;
+
+    while (ret == 0 && *cnx_list != 0) {
+        int n = atoi(cnx_list);
+
+        if (n <= 0 || nb_runs >= nb_max) {
+            ret = -1;
+        }
+        else {
+            nb_cnx[nb_runs++] = n;
+            while (*cnx_list >= '0' && *cnx_list <= '9') {
+                cnx_list++;
+            }
+            if (*cnx_list == ',') {
+                cnx_list++;
+            }
+            else if (*cnx_list != 0) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret == 0) {
+        *nb_values = nb_runs;
+    }
+
+    return (nb_runs == 0) ? -1 : ret;
+}
+
+/* Exclude the next steps from the measurement, e.g., processing at the peer */
+static void bench_pause()
+{
+    if (!bench_ctx.is_paused) {
+        bench_ctx.is_paused = 1;
+        bench_ctx.pause_start = bench_time_ns();
+    }
+}
+
+static void bench_resume()
+{
+    if (bench_ctx.is_paused) {
+        bench_ctx.paused_ns += bench_time_ns() - bench_ctx.pause_start;
+        bench_ctx.is_paused = 0;
+    }
+}
+
+static int bench_is_selected(char const* name)
+{
+    int is_selected = (bench_ctx.nb_filters == 0);
+
+    for (int i = 0; !is_selected && i < bench_ctx.nb_filters; i++) {
+        is_selected = (strstr(name, bench_ctx.filters[i]) != NULL);
+    }
+
+    return is_selected;
+}
+
+/* The names of the benchmarks start with the name of their group. A group is
+ * only set up if one of the filters could select one of its benchmarks. */
+static int bench_group_is_selected(char const* group_name)
+{
+    int is_selected = (bench_ctx.nb_filters == 0);
+
+    for (int i = 0; !is_selected && i < bench_ctx.nb_filters; i++) {
+        is_selected = (strstr(group_name, bench_ctx.filters[i]) != NULL ||
+            strncmp(bench_ctx.filters[i], group_name, strlen(group_name)) == 0);
+    }
+
+    return is_selected;
+}
+
+static int bench_run_once(bench_op_fn op, void* op_ctx, uint64_t nb_ops, uint64_t* duration_ns, uint64_t* nb_allocs)
+{
+    int ret;
+    uint64_t start_time;
+
+    bench_ctx.nb_allocs = 0;
+    bench_ctx.paused_ns = 0;
+    bench_ctx.is_paused = 0;
+    start_time = bench_time_ns();
+    ret = op(op_ctx, nb_ops);
+    bench_resume();
+    *duration_ns = bench_time_ns() - start_time - bench_ctx.paused_ns;
+    *nb_allocs = bench_ctx.nb_allocs;
+    /* Allocations made outside of the measurement, e.g., in the setup, are not counted */
+    bench_ctx.is_paused = 1;
+
+    return ret;
+}
+
+static int bench_compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Calibrate the number of operations per run, then run the operation
+ * several times and print the median cost. */
+static int bench_measure(char const* name, bench_op_fn op, void* op_ctx)
+{
+    int ret = 0;
+    uint64_t nb_ops = 1;
+    uint64_t duration_ns = 0;
+    uint64_t nb_allocs = 0;
+    double ns_per_op[BENCH_NB_RUNS];
+    double allocs_per_op[BENCH_NB_RUNS];
+
+    if (!bench_is_selected(name)) {
+        return 0;
+    }
+    bench_ctx.nb_benchmarks++;
+
+    /* Grow the number of operations until a run lasts at least a tenth of the target */
+    while (ret == 0 && (ret = bench_run_once(op, op_ctx, nb_ops, &duration_ns, &nb_allocs)) == 0 &&
+        duration_ns < bench_ctx.target_ns / 10 && nb_ops < (UINT64_MAX / 16)) {
+        nb_ops *= 10;
+    }
+    if (ret == 0 && duration_ns > 0) {
+        double scaled = ((double)nb_ops * (double)bench_ctx.target_ns) / (double)duration_ns;
+        nb_ops = (scaled < 1.0) ? 1 : (uint64_t)scaled;
+    }
+
+    for (int i = 0; ret == 0 && i < bench_ctx.nb_runs; i++) {
+        ret = bench_run_once(op, op_ctx, nb_ops, &duration_ns, &nb_allocs);
+        ns_per_op[i] = ((double)duration_ns) / ((double)nb_ops);
+        allocs_per_op[i] = ((double)nb_allocs) / ((double)nb_ops);
+    }
+
+    if (ret == 0) {
+        qsort(ns_per_op, bench_ctx.nb_runs, sizeof(double), bench_compare_double);
+        qsort(allocs_per_op, bench_ctx.nb_runs, sizeof(double), bench_compare_double);
+#ifdef PICOQUIC_BENCH_COUNT_ALLOC
+        printf("%-32s %12.1f ns/op %10.3f allocs/op %12" PRIu64 " ops/run\n", name,
+            ns_per_op[bench_ctx.nb_runs / 2], allocs_per_op[bench_ctx.nb_runs / 2], nb_ops);
+#else
+        printf("%-32s %12.1f ns/op %10s allocs/op %12" PRIu64 " ops/run\n", name,
+            ns_per_op[bench_ctx.nb_runs / 2], "n/a", nb_ops);
+#endif
+    }
+    else {
+        printf("%-32s failed, error %d (0x%x)\n", name, ret, ret);
+    }
+    fflush(stdout);
+
+    return ret;
+}
+
+/* Connections established over the simulated network of the test library.
+ * The simulated time must remain at the same address for the life of
+ * the connection, and is thus part of the state. */
+typedef struct st_bench_cnx_t {
+    picoquic_test_tls_api_ctx_t* test_ctx;
+    uint64_t simulated_time;
+} bench_cnx_t;
+
+static int bench_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(callback_ctx);
+    UNREFERENCED_PARAMETER(v_stream_ctx);
+#endif
+    if (fin_or_event == picoquic_callback_prepare_to_send) {
+        /* Keep the stream active, so the sender is always loaded */
+        uint8_t* buffer = picoquic_provide_stream_data_buffer(bytes, length, 0, 1);
+        if (buffer != NULL) {
+            memset(buffer, 0x5a, length);
+        }
+    }
+    return 0;
+}
+
+static int bench_cnx_init(bench_cnx_t* bench_cnx, int cipher_suite_id)
+{
+    int ret;
+
+    memset(bench_cnx, 0, sizeof(bench_cnx_t));
+    ret = tls_api_init_ctx(&bench_cnx->test_ctx, PICOQUIC_INTERNAL_TEST_VERSION_1, PICOQUIC_TEST_SNI,
+        PICOQUIC_TEST_ALPN, &bench_cnx->simulated_time, NULL, NULL, 0, 1, 0);
+    if (ret == 0 && cipher_suite_id != 0) {
+        ret = picoquic_set_cipher_suite(bench_cnx->test_ctx->qclient, cipher_suite_id);
+    }
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_connect(bench_cnx->test_ctx, &bench_cnx->simulated_time, 0, 0, 0);
+    }
+    if (ret == 0 && (bench_cnx->test_ctx->cnx_server == NULL ||
+        bench_cnx->test_ctx->cnx_client->cnx_state != picoquic_state_ready)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        picoquic_set_callback(bench_cnx->test_ctx->cnx_client, bench_callback, NULL);
+        picoquic_set_callback(bench_cnx->test_ctx->cnx_server, bench_callback, NULL);
+    }
+
+    return ret;
+}
+
+static void bench_cnx_release(bench_cnx_t* bench_cnx)
+{
+    if (bench_cnx->test_ctx != NULL) {
+        tls_api_delete_ctx(bench_cnx->test_ctx);
+        bench_cnx->test_ctx = NULL;
+    }
+}
+
+/* Varint encoding and decoding, over a mix of 1, 2, 4 and 8 bytes values */
+typedef struct st_bench_varint_t {
+    uint64_t values[256];
+    uint8_t buffer[256 * 8];
+    size_t length;
+} bench_varint_t;
+
+static int bench_varint_encode_op(void* op_ctx, uint64_t nb_ops)
+{
+    bench_varint_t* varint = (bench_varint_t*)op_ctx;
+    uint8_t* bytes = varint->buffer;
+    uint8_t* bytes_max = varint->buffer + sizeof(varint->buffer);
+
+    for (uint64_t i = 0; i < nb_ops && bytes != NULL; i++) {
+        size_t x = (size_t)(i & 255);
+        if (x == 0) {
+            bytes = varint->buffer;
+        }
+        bytes = picoquic_frames_varint_encode(bytes, bytes_max, varint->values[x]);
+    }
+
+    return (bytes == NULL) ? -1 : 0;
+}
+
+static int bench_varint_decode_op(void* op_ctx, uint64_t nb_ops)
+{
+    bench_varint_t* varint = (bench_varint_t*)op_ctx;
+    const uint8_t* bytes = varint->buffer;
+    const uint8_t* bytes_max = varint->buffer + varint->length;
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < nb_ops && bytes != NULL; i++) {
+        uint64_t v = 0;
+        if ((i & 255) == 0) {
+            bytes = varint->buffer;
+        }
+        bytes = picoquic_frames_varint_decode(bytes, bytes_max, &v);
+        sum += v;
+    }
+
+    return (bytes == NULL || sum == 0) ? -1 : 0;
+}
+
+static int bench_varint()
+{
+    int ret = 0;
+    bench_varint_t varint;
+    uint8_t* bytes = varint.buffer;
+    uint64_t random_ctx = 0xdeadbeefbaadf00dull;
+
+    memset(&varint, 0, sizeof(varint));
+    for (size_t i = 0; i < 256 && bytes != NULL; i++) {
+        static const uint64_t masks[4] = { 0x3full, 0x3fffull, 0x3fffffffull, 0x3fffffffffffffffull };
+        varint.values[i] = picoquic_test_random(&random_ctx) & masks[i & 3];
+        bytes = picoquic_frames_varint_encode(bytes, varint.buffer + sizeof(varint.buffer), varint.values[i]);
+    }
+    if (bytes == NULL) {
+        ret = -1;
+    }
+    else {
+        varint.length = bytes - varint.buffer;
+        ret = bench_measure("varint_encode", bench_varint_encode_op, &varint);
+        if (ret == 0) {
+            ret = bench_measure("varint_decode", bench_varint_decode_op, &varint);
+        }
+    }
+
+    return ret;
+}
+
+/* Header parsing of a short header packet sent by the client */
+typedef struct st_bench_packet_t {
+    bench_cnx_t bench_cnx;
+    uint8_t packet[PICOQUIC_MAX_PACKET_SIZE];
+    size_t length;
+} bench_packet_t;
+
+static int bench_parse_header_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_packet_t* bp = (bench_packet_t*)op_ctx;
+    picoquic_test_tls_api_ctx_t* test_ctx = bp->bench_cnx.test_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        picoquic_packet_header ph;
+        picoquic_cnx_t* cnx = NULL;
+
+        ret = picoquic_parse_packet_header(test_ctx->qserver, bp->packet, bp->length,
+            (struct sockaddr*)&test_ctx->client_addr, &ph, &cnx, 1);
+        if (ret == 0 && cnx != test_ctx->cnx_server) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_parse_header()
+{
+    int ret;
+    bench_packet_t* bp = (bench_packet_t*)malloc(sizeof(bench_packet_t));
+
+    if (bp == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((ret = bench_cnx_init(&bp->bench_cnx, 0)) == 0) {
+        picoquic_test_tls_api_ctx_t* test_ctx = bp->bench_cnx.test_ctx;
+        uint8_t data[256];
+        struct sockaddr_storage addr_to;
+        struct sockaddr_storage addr_from;
+        int if_index = 0;
+
+        memset(data, 0x5a, sizeof(data));
+        bp->length = 0;
+        ret = picoquic_add_to_stream(test_ctx->cnx_client, 0, data, sizeof(data), 0);
+        if (ret == 0) {
+            ret = picoquic_prepare_packet(test_ctx->cnx_client, bp->bench_cnx.simulated_time,
+                bp->packet, sizeof(bp->packet), &bp->length, &addr_to, &addr_from, &if_index);
+        }
+        if (ret == 0 && bp->length == 0) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = bench_measure("parse_packet_header", bench_parse_header_op, bp);
+        }
+    }
+
+    if (bp != NULL) {
+        bench_cnx_release(&bp->bench_cnx);
+        free(bp);
+    }
+
+    return ret;
+}
+
+/* Frame decoding, on a packet content made of an ACK frame formatted by
+ * the server, a 1000 bytes STREAM frame, a MAX_DATA frame and a PING.
+ * The stream offset is updated at each iteration, so the data is always
+ * new and delivered to the application. */
+typedef struct st_bench_frames_t {
+    bench_cnx_t bench_cnx;
+    uint8_t frames[PICOQUIC_MAX_PACKET_SIZE];
+    size_t length;
+    uint8_t* offset_bytes;
+    uint64_t stream_offset;
+} bench_frames_t;
+
+static int bench_decode_frames_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_frames_t* bf = (bench_frames_t*)op_ctx;
+    picoquic_cnx_t* cnx = bf->bench_cnx.test_ctx->cnx_client;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        /* The offset is encoded as an 8 bytes varint, and can be overwritten in place */
+        (void)picoquic_frames_uint64_encode(bf->offset_bytes, bf->offset_bytes + 8, bf->stream_offset | 0xc000000000000000ull);
+        bf->stream_offset += BENCH_STREAM_FRAME_LENGTH;
+        ret = picoquic_decode_frames(cnx, cnx->path[0], bf->frames, bf->length, NULL, picoquic_epoch_1rtt,
+            NULL, NULL, i, 0, bf->bench_cnx.simulated_time);
+    }
+
+    return ret;
+}
+
+static int bench_decode_frames()
+{
+    int ret;
+    bench_frames_t* bf = (bench_frames_t*)malloc(sizeof(bench_frames_t));
+
+    if (bf == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((ret = bench_cnx_init(&bf->bench_cnx, 0)) == 0) {
+        picoquic_test_tls_api_ctx_t* test_ctx = bf->bench_cnx.test_ctx;
+        uint8_t* bytes = bf->frames;
+        uint8_t* bytes_max = bf->frames + sizeof(bf->frames);
+        int more_data = 0;
+
+        test_ctx->cnx_server->ack_ctx[picoquic_packet_context_application].act[0].ack_needed = 1;
+        bytes = picoquic_format_ack_frame(test_ctx->cnx_server, bytes, bytes_max, &more_data,
+            bf->bench_cnx.simulated_time, picoquic_packet_context_application, 0);
+        /* STREAM frame with offset and length on server initiated stream 1 */
+        if (bytes == bf->frames ||
+            (bytes = picoquic_frames_uint8_encode(bytes, bytes_max, picoquic_frame_type_stream_range_min | 0x06)) == NULL ||
+            (bytes = picoquic_frames_varint_encode(bytes, bytes_max, 1)) == NULL) {
+            ret = -1;
+        }
+        else {
+            bf->offset_bytes = bytes;
+            if ((bytes = picoquic_frames_uint64_encode(bytes, bytes_max, 0xc000000000000000ull)) == NULL ||
+                (bytes = picoquic_frames_varint_encode(bytes, bytes_max, BENCH_STREAM_FRAME_LENGTH)) == NULL ||
+                bytes + BENCH_STREAM_FRAME_LENGTH > bytes_max) {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            memset(bytes, 0x5a, BENCH_STREAM_FRAME_LENGTH);
+            bytes += BENCH_STREAM_FRAME_LENGTH;
+            if ((bytes = picoquic_frames_uint8_encode(bytes, bytes_max, picoquic_frame_type_max_data)) == NULL ||
+                (bytes = picoquic_frames_varint_encode(bytes, bytes_max, 0x100000)) == NULL ||
+                (bytes = picoquic_frames_uint8_encode(bytes, bytes_max, picoquic_frame_type_ping)) == NULL) {
+                ret = -1;
+            }
+            else {
+                bf->length = bytes - bf->frames;
+                bf->stream_offset = 0;
+                /* Flow control would stop the data long before the end of the test */
+                test_ctx->cnx_client->maxdata_local = UINT64_MAX >> 2;
+                test_ctx->cnx_client->local_parameters.initial_max_stream_data_bidi_remote = UINT64_MAX >> 2;
+                ret = bench_measure("decode_frames", bench_decode_frames_op, bf);
+            }
+        }
+    }
+
+    if (bf != NULL) {
+        bench_cnx_release(&bf->bench_cnx);
+        free(bf);
+    }
+
+    return ret;
+}
+
+/* ACK frame formatting with N ranges. The repeat counts of the ranges are
+ * reset before each operation, so all the ranges are candidates. */
+typedef struct st_bench_ack_t {
+    picoquic_cnx_t* cnx;
+    picoquic_ack_context_t ack_ctx;
+    uint64_t current_time;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+} bench_ack_t;
+
+static int bench_format_ack_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_ack_t* ba = (bench_ack_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        picoquic_sack_item_t* sack = picoquic_sack_first_item(&ba->ack_ctx.sack_list);
+        uint8_t* bytes;
+        int more_data = 0;
+        int need_time_stamp = 0;
+
+        while (sack != NULL) {
+            picoquic_sack_item_record_reset(&ba->ack_ctx.sack_list, sack);
+            sack = picoquic_sack_next_item(&ba->ack_ctx.sack_list, sack);
+        }
+        ba->ack_ctx.act[0].ack_needed = 1;
+        bytes = picoquic_format_ack_frame_in_context(ba->cnx, ba->buffer, ba->buffer + sizeof(ba->buffer),
+            &more_data, ba->current_time, &ba->ack_ctx, &need_time_stamp, UINT64_MAX, 0);
+        if (bytes == ba->buffer) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_format_ack()
+{
+    static const size_t nb_ranges[] = { 1, 8, 32, 256 };
+    int ret = 0;
+    bench_cnx_t bench_cnx;
+    bench_ack_t* ba = (bench_ack_t*)malloc(sizeof(bench_ack_t));
+
+    memset(&bench_cnx, 0, sizeof(bench_cnx));
+    if (ba == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        ret = bench_cnx_init(&bench_cnx, 0);
+    }
+
+    for (size_t r = 0; ret == 0 && r < sizeof(nb_ranges) / sizeof(size_t); r++) {
+        char name[64];
+
+        memset(ba, 0, sizeof(bench_ack_t));
+        ba->cnx = bench_cnx.test_ctx->cnx_client;
+        ba->current_time = bench_cnx.simulated_time;
+        picoquic_sack_list_init(&ba->ack_ctx.sack_list);
+        for (size_t i = 0; ret == 0 && i < nb_ranges[r]; i++) {
+            /* Ranges of 4 packets, separated by holes of 2 packets */
+            if (picoquic_update_sack_list(&ba->ack_ctx.sack_list, 6 * i, 6 * i + 3, ba->current_time) != 0) {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            (void)picoquic_sprintf(name, sizeof(name), NULL, "format_ack_%d_ranges", (int)nb_ranges[r]);
+            ret = bench_measure(name, bench_format_ack_op, ba);
+        }
+        picoquic_sack_list_free(&ba->ack_ctx.sack_list);
+    }
+
+    bench_cnx_release(&bench_cnx);
+    if (ba != NULL) {
+        free(ba);
+    }
+
+    return ret;
+}
+
+/* Hash table and splay lookups of existing keys */
+typedef struct st_bench_key_t {
+    uint64_t key;
+    picohash_item hash_item;
+    picosplay_node_t node;
+} bench_key_t;
+
+typedef struct st_bench_table_t {
+    bench_key_t keys[BENCH_NB_TABLE_ENTRIES];
+    picohash_table* hash_table;
+    uint8_t hash_seed[16]; /* The table keeps a reference to the seed */
+    picosplay_tree_t tree;
+} bench_table_t;
+
+static uint64_t bench_key_hash(const void* key, const uint8_t* hash_seed)
+{
+    const bench_key_t* k = (const bench_key_t*)key;
+
+    return picohash_siphash((const uint8_t*)&k->key, sizeof(k->key), hash_seed);
+}
+
+static int bench_key_compare(const void* key1, const void* key2)
+{
+    return (((const bench_key_t*)key1)->key == ((const bench_key_t*)key2)->key) ? 0 : -1;
+}
+
+static picohash_item* bench_key_to_item(const void* key)
+{
+    return &((bench_key_t*)key)->hash_item;
+}
+
+static int64_t bench_node_compare(void* l, void* r)
+{
+    uint64_t x = ((bench_key_t*)l)->key;
+    uint64_t y = ((bench_key_t*)r)->key;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static picosplay_node_t* bench_node_create(void* value)
+{
+    return &((bench_key_t*)value)->node;
+}
+
+static void* bench_node_value(picosplay_node_t* node)
+{
+    return (void*)((char*)node - offsetof(struct st_bench_key_t, node));
+}
+
+static void bench_node_delete(void* tree, picosplay_node_t* node)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(tree);
+#endif
+    memset(node, 0, sizeof(picosplay_node_t));
+}
+
+static int bench_hash_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_table_t* table = (bench_table_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        /* Visit the keys in a scattered order */
+        bench_key_t* key = &table->keys[(i * 1021) % BENCH_NB_TABLE_ENTRIES];
+        if (picohash_retrieve(table->hash_table, key) == NULL) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_splay_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_table_t* table = (bench_table_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        bench_key_t* key = &table->keys[(i * 1021) % BENCH_NB_TABLE_ENTRIES];
+        if (picosplay_find(&table->tree, key) == NULL) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_table_fill_hash(bench_table_t* table, int is_open)
+{
+    int ret = 0;
+
+    memset(table->hash_seed, 0x17, sizeof(table->hash_seed));
+    table->hash_table = (is_open) ?
+        picohash_create_open(BENCH_NB_TABLE_ENTRIES, bench_key_hash, bench_key_compare, bench_key_to_item, table->hash_seed) :
+        picohash_create_ex(BENCH_NB_TABLE_ENTRIES, bench_key_hash, bench_key_compare, bench_key_to_item, table->hash_seed);
+    if (table->hash_table == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    for (size_t i = 0; ret == 0 && i < BENCH_NB_TABLE_ENTRIES; i++) {
+        ret = picohash_insert(table->hash_table, &table->keys[i]);
+    }
+
+    return ret;
+}
+
+static int bench_lookups()
+{
+    int ret = 0;
+    bench_table_t* table = (bench_table_t*)malloc(sizeof(bench_table_t));
+    uint64_t random_ctx = 0x0123456789abcdefull;
+
+    if (table == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(table, 0, sizeof(bench_table_t));
+        for (size_t i = 0; i < BENCH_NB_TABLE_ENTRIES; i++) {
+            /* Unique keys: the random value is shifted to make room for the index */
+            table->keys[i].key = (picoquic_test_random(&random_ctx) << 12) | i;
+        }
+
+        if ((ret = bench_table_fill_hash(table, 0)) == 0) {
+            ret = bench_measure("lookup_picohash", bench_hash_op, table);
+        }
+        if (table->hash_table != NULL) {
+            picohash_delete(table->hash_table, 0);
+            table->hash_table = NULL;
+        }
+        if (ret == 0 && (ret = bench_table_fill_hash(table, 1)) == 0) {
+            ret = bench_measure("lookup_picohash_open", bench_hash_op, table);
+        }
+        if (table->hash_table != NULL) {
+            picohash_delete(table->hash_table, 0);
+            table->hash_table = NULL;
+        }
+        if (ret == 0) {
+            picosplay_init_tree(&table->tree, bench_node_compare, bench_node_create, bench_node_delete, bench_node_value);
+            for (size_t i = 0; i < BENCH_NB_TABLE_ENTRIES; i++) {
+                picosplay_insert(&table->tree, &table->keys[i]);
+            }
+            ret = bench_measure("lookup_picosplay", bench_splay_op, table);
+            picosplay_empty_tree(&table->tree);
+        }
+        free(table);
+    }
+
+    return ret;
+}
+
+/* AEAD seal and open of 1200 bytes packets, using the 1-RTT keys of a
+ * connection negotiated with each cipher suite */
+typedef struct st_bench_aead_t {
+    bench_cnx_t bench_cnx;
+    uint8_t header[BENCH_AEAD_HEADER_LENGTH];
+    uint8_t clear_text[BENCH_AEAD_LENGTH];
+    uint8_t sealed[BENCH_AEAD_LENGTH + 32];
+    uint8_t output[BENCH_AEAD_LENGTH + 32];
+    size_t sealed_length;
+} bench_aead_t;
+
+static int bench_aead_seal_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_aead_t* ba = (bench_aead_t*)op_ctx;
+    void* aead_ctx = ba->bench_cnx.test_ctx->cnx_client->crypto_context[picoquic_epoch_1rtt].aead_encrypt;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        if (picoquic_aead_encrypt_generic(ba->output, ba->clear_text, BENCH_AEAD_LENGTH, i,
+            ba->header, BENCH_AEAD_HEADER_LENGTH, aead_ctx) != ba->sealed_length) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_aead_open_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_aead_t* ba = (bench_aead_t*)op_ctx;
+    void* aead_ctx = ba->bench_cnx.test_ctx->cnx_server->crypto_context[picoquic_epoch_1rtt].aead_decrypt;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        if (picoquic_aead_decrypt_generic(ba->output, ba->sealed, ba->sealed_length, 0,
+            ba->header, BENCH_AEAD_HEADER_LENGTH, aead_ctx) != BENCH_AEAD_LENGTH) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_aead()
+{
+    static const struct {
+        int cipher_suite_id;
+        char const* seal_name;
+        char const* open_name;
+    } suites[] = {
+        { PICOQUIC_AES_128_GCM_SHA256, "aead_seal_aes128gcm", "aead_open_aes128gcm" },
+        { PICOQUIC_AES_256_GCM_SHA384, "aead_seal_aes256gcm", "aead_open_aes256gcm" },
+        { PICOQUIC_CHACHA20_POLY1305_SHA256, "aead_seal_chacha20poly1305", "aead_open_chacha20poly1305" }
+    };
+    int ret = 0;
+    bench_aead_t* ba = (bench_aead_t*)malloc(sizeof(bench_aead_t));
+
+    if (ba == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+
+    for (size_t s = 0; ret == 0 && s < sizeof(suites) / sizeof(suites[0]); s++) {
+        if (!bench_is_selected(suites[s].seal_name) && !bench_is_selected(suites[s].open_name)) {
+            continue;
+        }
+        memset(ba, 0, sizeof(bench_aead_t));
+        memset(ba->header, 0x41, sizeof(ba->header));
+        memset(ba->clear_text, 0x5a, sizeof(ba->clear_text));
+        if (bench_cnx_init(&ba->bench_cnx, suites[s].cipher_suite_id) != 0) {
+            /* Not all providers support all the cipher suites */
+            printf("%-32s not supported\n", suites[s].seal_name);
+        }
+        else {
+            ba->sealed_length = picoquic_aead_encrypt_generic(ba->sealed, ba->clear_text, BENCH_AEAD_LENGTH, 0,
+                ba->header, BENCH_AEAD_HEADER_LENGTH, ba->bench_cnx.test_ctx->cnx_client->crypto_context[picoquic_epoch_1rtt].aead_encrypt);
+            if (ba->sealed_length <= BENCH_AEAD_LENGTH || ba->sealed_length > sizeof(ba->sealed)) {
+                ret = -1;
+            }
+            else if ((ret = bench_measure(suites[s].seal_name, bench_aead_seal_op, ba)) == 0) {
+                ret = bench_measure(suites[s].open_name, bench_aead_open_op, ba);
+            }
+        }
+        bench_cnx_release(&ba->bench_cnx);
+    }
+
+    if (ba != NULL) {
+        free(ba);
+    }
+
+    return ret;
+}
+
+/* Packet preparation by a client that always has data to send. Only the
+ * calls to picoquic_prepare_packet_ex are measured; the delivery of the
+ * packets to the server and of the server's acknowledgements to the
+ * client are excluded. The cost is counted per packet sent. */
+typedef struct st_bench_prepare_t {
+    bench_cnx_t bench_cnx;
+    uint8_t send_buffer[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t peer_buffer[PICOQUIC_MAX_PACKET_SIZE];
+} bench_prepare_t;
+
+static int bench_prepare_deliver_to_client(bench_prepare_t* bp)
+{
+    int ret = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = bp->bench_cnx.test_ctx;
+    size_t send_length;
+
+    do {
+        struct sockaddr_storage addr_to;
+        struct sockaddr_storage addr_from;
+        size_t send_msg_size = 0;
+        int if_index = 0;
+
+        send_length = 0;
+        ret = picoquic_prepare_packet_ex(test_ctx->cnx_server, bp->bench_cnx.simulated_time,
+            bp->peer_buffer, sizeof(bp->peer_buffer), &send_length, &addr_to, &addr_from, &if_index, &send_msg_size);
+        if (ret == 0 && send_length > 0) {
+            ret = picoquic_incoming_packet(test_ctx->qclient, bp->peer_buffer, send_length,
+                (struct sockaddr*)&test_ctx->server_addr, (struct sockaddr*)&test_ctx->client_addr, 0, 0,
+                bp->bench_cnx.simulated_time);
+        }
+    } while (ret == 0 && send_length > 0);
+
+    return ret;
+}
+
+static int bench_prepare_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_prepare_t* bp = (bench_prepare_t*)op_ctx;
+    picoquic_test_tls_api_ctx_t* test_ctx = bp->bench_cnx.test_ctx;
+    uint64_t nb_packets = 0;
+
+    while (ret == 0 && nb_packets < nb_ops) {
+        struct sockaddr_storage addr_to;
+        struct sockaddr_storage addr_from;
+        size_t send_length = 0;
+        size_t send_msg_size = 0;
+        int if_index = 0;
+
+        ret = picoquic_prepare_packet_ex(test_ctx->cnx_client, bp->bench_cnx.simulated_time,
+            bp->send_buffer, sizeof(bp->send_buffer), &send_length, &addr_to, &addr_from, &if_index, &send_msg_size);
+        bench_pause();
+        if (ret == 0 && send_length > 0) {
+            nb_packets++;
+            ret = picoquic_incoming_packet(test_ctx->qserver, bp->send_buffer, send_length,
+                (struct sockaddr*)&test_ctx->client_addr, (struct sockaddr*)&test_ctx->server_addr, 0, 0,
+                bp->bench_cnx.simulated_time);
+        }
+        if (ret == 0) {
+            ret = bench_prepare_deliver_to_client(bp);
+        }
+        if (ret == 0 && send_length == 0) {
+            /* The client is blocked by congestion control or pacing, move to the next event */
+            uint64_t next_time = picoquic_get_next_wake_time(test_ctx->qclient, UINT64_MAX);
+            uint64_t server_time = picoquic_get_next_wake_time(test_ctx->qserver, UINT64_MAX);
+
+            if (server_time < next_time) {
+                next_time = server_time;
+            }
+            bp->bench_cnx.simulated_time = (next_time > bp->bench_cnx.simulated_time && next_time != UINT64_MAX) ?
+                next_time : bp->bench_cnx.simulated_time + 1;
+        }
+        if (ret == 0 && (test_ctx->cnx_client->cnx_state != picoquic_state_ready ||
+            test_ctx->cnx_server->cnx_state != picoquic_state_ready)) {
+            ret = -1;
+        }
+        bench_resume();
+    }
+
+    return ret;
+}
+
+static int bench_prepare()
+{
+    int ret;
+    bench_prepare_t* bp = (bench_prepare_t*)malloc(sizeof(bench_prepare_t));
+
+    if (bp == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if ((ret = bench_cnx_init(&bp->bench_cnx, 0)) == 0 &&
+        (ret = picoquic_mark_active_stream(bp->bench_cnx.test_ctx->cnx_client, 0, 1, NULL)) == 0) {
+        ret = bench_measure("prepare_packet_ex", bench_prepare_op, bp);
+    }
+
+    if (bp != NULL) {
+        bench_cnx_release(&bp->bench_cnx);
+        free(bp);
+    }
+
+    return ret;
+}
+
+/* QPACK parsing of typical request and response header frames */
+typedef struct st_bench_qpack_t {
+    uint8_t frame[1024];
+    size_t length;
+} bench_qpack_t;
+
+static int bench_qpack_parse_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_qpack_t* bq = (bench_qpack_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        h3zero_header_parts_t parts;
+
+        memset(&parts, 0, sizeof(parts));
+        if (h3zero_parse_qpack_header_frame(bq->frame, bq->frame + bq->length, &parts) != bq->frame + bq->length) {
+            ret = -1;
+        }
+        h3zero_release_header_parts(&parts);
+    }
+
+    return ret;
+}
+
+static int bench_qpack()
+{
+    int ret = 0;
+    bench_qpack_t bq;
+    static const char path[] = "/images/2026/october/picture_of_the_day.jpg";
+    uint8_t* bytes;
+
+    bytes = h3zero_create_request_header_frame_ex(bq.frame, bq.frame + sizeof(bq.frame),
+        (const uint8_t*)path, sizeof(path) - 1, NULL, 0, "www.example.com", "picoquic-bench");
+    if (bytes == NULL) {
+        ret = -1;
+    }
+    else {
+        bq.length = bytes - bq.frame;
+        ret = bench_measure("qpack_parse_request", bench_qpack_parse_op, &bq);
+    }
+
+    if (ret == 0) {
+        bytes = h3zero_create_response_header_frame(bq.frame, bq.frame + sizeof(bq.frame), h3zero_content_type_text_html);
+        if (bytes == NULL) {
+            ret = -1;
+        }
+        else {
+            bq.length = bytes - bq.frame;
+            ret = bench_measure("qpack_parse_response", bench_qpack_parse_op, &bq);
+        }
+    }
+
+    return ret;
+}
+
+/* Replay of a corpus extracted from packet captures, see pcap_corpus.c.
+ * Each operation processes the next item of the corpus, so the costs are
+ * averaged over the frames and header blocks of real traffic. The group
+ * is skipped if no corpus file is loaded. */
+typedef struct st_bench_corpus_items_t {
+    bench_corpus_record_t* items;
+    size_t nb_items;
+    size_t next_item;
+    picoquic_sack_list_t sack_list;
+} bench_corpus_items_t;
+
+static bench_corpus_record_t* bench_corpus_next_item(bench_corpus_items_t* bci)
+{
+    bench_corpus_record_t* item = &bci->items[bci->next_item];
+
+    bci->next_item++;
+    if (bci->next_item >= bci->nb_items) {
+        bci->next_item = 0;
+    }
+
+    return item;
+}
+
+static int bench_corpus_skip_frames_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_corpus_items_t* bci = (bench_corpus_items_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        bench_corpus_record_t* item = bench_corpus_next_item(bci);
+        size_t byte_index = 0;
+
+        while (ret == 0 && byte_index < item->length) {
+            size_t consumed = 0;
+            int pure_ack = 0;
+
+            ret = picoquic_skip_frame(item->data + byte_index, item->length - byte_index, &consumed, &pure_ack);
+            byte_index += consumed;
+        }
+    }
+
+    return ret;
+}
+
+/* Parse the ACK frame, and if sack_list is not NULL add the acknowledged
+ * ranges to it, as done when processing the ACK of ACK. */
+static int bench_corpus_ack_parse(const uint8_t* bytes, size_t length, picoquic_sack_list_t* sack_list)
+{
+    const uint8_t* bytes_max = bytes + length;
+    uint8_t frame_type = bytes[0];
+    uint64_t num_block = 0;
+    uint64_t largest = 0;
+    uint64_t ack_delay = 0;
+    uint64_t range = 0;
+    size_t consumed = 0;
+    int ret = picoquic_parse_ack_header(bytes, length, &num_block, NULL, &largest, &ack_delay, &consumed, 3);
+
+    bytes += consumed;
+    if (ret == 0 && (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range)) == NULL) {
+        ret = -1;
+    }
+
+    while (ret == 0) {
+        uint64_t smallest;
+        uint64_t gap = 0;
+
+        if (range > largest) {
+            ret = -1;
+            break;
+        }
+        smallest = largest - range;
+        if (sack_list != NULL) {
+            ret = picoquic_update_sack_list(sack_list, smallest, largest, 0);
+        }
+        if (ret != 0 || num_block == 0) {
+            break;
+        }
+        num_block--;
+        if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &gap)) == NULL ||
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &range)) == NULL ||
+            smallest < gap + 2) {
+            ret = -1;
+        }
+        else {
+            largest = smallest - gap - 2;
+        }
+    }
+
+    if (ret == 0 && frame_type == picoquic_frame_type_ack_ecn) {
+        uint64_t ecn_counts[3];
+
+        if ((bytes = picoquic_frames_varint_decode_batch(bytes, bytes_max, ecn_counts, 3)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int bench_corpus_parse_ack_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_corpus_items_t* bci = (bench_corpus_items_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        bench_corpus_record_t* item = bench_corpus_next_item(bci);
+
+        ret = bench_corpus_ack_parse(item->data, item->length, NULL);
+    }
+
+    return ret;
+}
+
+static int bench_corpus_ack_to_sack_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_corpus_items_t* bci = (bench_corpus_items_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        bench_corpus_record_t* item = bench_corpus_next_item(bci);
+
+        ret = bench_corpus_ack_parse(item->data, item->length, &bci->sack_list);
+        picoquic_sack_list_free(&bci->sack_list);
+        picoquic_sack_list_init(&bci->sack_list);
+    }
+
+    return ret;
+}
+
+static int bench_corpus_qpack_op(void* op_ctx, uint64_t nb_ops)
+{
+    int ret = 0;
+    bench_corpus_items_t* bci = (bench_corpus_items_t*)op_ctx;
+
+    for (uint64_t i = 0; ret == 0 && i < nb_ops; i++) {
+        bench_corpus_record_t* item = bench_corpus_next_item(bci);
+        uint8_t* block = (uint8_t*)item->data;
+        h3zero_header_parts_t parts;
+
+        memset(&parts, 0, sizeof(parts));
+        if (h3zero_parse_qpack_header_frame(block, block + item->length, &parts) != block + item->length) {
+            ret = -1;
+        }
+        h3zero_release_header_parts(&parts);
+    }
+
+    return ret;
+}
+
+/* Select the records of one type, or for ack_only the ACK frames found in
+ * the frame records. */
+static int bench_corpus_select(bench_corpus_items_t* bci, uint64_t record_type, int ack_only)
+{
+    int ret = 0;
+    bench_corpus_t* corpus = bench_ctx.corpus;
+
+    memset(bci, 0, sizeof(bench_corpus_items_t));
+    picoquic_sack_list_init(&bci->sack_list);
+    for (int pass = 0; ret == 0 && pass < 2; pass++) {
+        size_t nb_items = 0;
+
+        for (size_t i = 0; ret == 0 && i < corpus->nb_records; i++) {
+            bench_corpus_record_t* record = &corpus->records[i];
+
+            if (record->record_type != record_type) {
+                continue;
+            }
+            if (!ack_only) {
+                if (pass == 1) {
+                    bci->items[nb_items] = *record;
+                }
+                nb_items++;
+            }
+            else {
+                size_t byte_index = 0;
+
+                while (ret == 0 && byte_index < record->length) {
+                    size_t consumed = 0;
+                    int pure_ack = 0;
+                    uint8_t frame_type = record->data[byte_index];
+
+                    ret = picoquic_skip_frame(record->data + byte_index, record->length - byte_index, &consumed, &pure_ack);
+                    if (ret == 0 && (frame_type == picoquic_frame_type_ack || frame_type == picoquic_frame_type_ack_ecn)) {
+                        if (pass == 1) {
+                            bci->items[nb_items].record_type = record_type;
+                            bci->items[nb_items].data = record->data + byte_index;
+                            bci->items[nb_items].length = consumed;
+                        }
+                        nb_items++;
+                    }
+                    byte_index += consumed;
+                }
+            }
+        }
+        if (ret == 0 && pass == 0 && nb_items > 0) {
+            if ((bci->items = (bench_corpus_record_t*)malloc(nb_items * sizeof(bench_corpus_record_t))) == NULL) {
+                ret = PICOQUIC_ERROR_MEMORY;
+            }
+            else {
+                bci->nb_items = nb_items;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static void bench_corpus_unselect(bench_corpus_items_t* bci)
+{
+    if (bci->items != NULL) {
+        free(bci->items);
+    }
+    picoquic_sack_list_free(&bci->sack_list);
+    memset(bci, 0, sizeof(bench_corpus_items_t));
+}
+
+static int bench_corpus()
+{
+    static const struct {
+        char const* name;
+        bench_op_fn op;
+        uint64_t record_type;
+        int ack_only;
+    } corpus_benches[] = {
+        { "corpus_skip_frames", bench_corpus_skip_frames_op, BENCH_CORPUS_RECORD_FRAMES, 0 },
+        { "corpus_parse_ack", bench_corpus_parse_ack_op, BENCH_CORPUS_RECORD_FRAMES, 1 },
+        { "corpus_ack_to_sack", bench_corpus_ack_to_sack_op, BENCH_CORPUS_RECORD_FRAMES, 1 },
+        { "corpus_qpack_parse", bench_corpus_qpack_op, BENCH_CORPUS_RECORD_HEADERS, 0 }
+    };
+    int ret = 0;
+
+    if (bench_ctx.corpus == NULL) {
+        return 0;
+    }
+
+    for (size_t b = 0; ret == 0 && b < sizeof(corpus_benches) / sizeof(corpus_benches[0]); b++) {
+        bench_corpus_items_t bci;
+
+        if (!bench_is_selected(corpus_benches[b].name)) {
+            continue;
+        }
+        if ((ret = bench_corpus_select(&bci, corpus_benches[b].record_type, corpus_benches[b].ack_only)) == 0) {
+            if (bci.nb_items == 0) {
+                printf("%-32s no matching record in the corpus\n", corpus_benches[b].name);
+            }
+            else {
+                ret = bench_measure(corpus_benches[b].name, corpus_benches[b].op, &bci);
+            }
+        }
+        bench_corpus_unselect(&bci);
+    }
+
+    return ret;
+}
+
+typedef struct st_bench_def_t {
+    char const* bench_name;
+    int (*bench_fn)();
+} bench_def_t;
+
+static const bench_def_t bench_table[] = {
+    { "varint", bench_varint },
+    { "parse_packet_header", bench_parse_header },
+    { "decode_frames", bench_decode_frames },
+    { "format_ack", bench_format_ack },
+    { "lookups", bench_lookups },
+    { "aead", bench_aead },
+    { "prepare_packet", bench_prepare },
+    { "qpack", bench_qpack },
+    { "corpus", bench_corpus }
+};
+
+static size_t const nb_bench = sizeof(bench_table) / sizeof(bench_def_t);
+
+static int usage(char const* argv0)
+{
+    fprintf(stderr, "PicoQUIC microbenchmarks\n");
+    fprintf(stderr, "Usage: %s [-S solution_dir] [-q] [-v] [filter1 [filter2 ..[filterN]]]\n", argv0);
+    fprintf(stderr, "   Or: %s [-S solution_dir] -L volume_mb [loopback options]\n", argv0);
+    fprintf(stderr, "   Or: %s [-S solution_dir] -C n1,n2,.. [-K sample]\n", argv0);
+    fprintf(stderr, "   Or: %s -R capture.pcap -k keylog_file -W corpus_file\n\n", argv0);
+    fprintf(stderr, "Only the benchmarks whose names contain one of the filters are run.\n");
+    fprintf(stderr, "Benchmark names start with the name of their group. Valid groups are: \n");
+    for (size_t x = 0; x < nb_bench; x++) {
+        fprintf(stderr, "    %s\n", bench_table[x].bench_name);
+    }
+    fprintf(stderr, "Options: \n");
+    fprintf(stderr, "  -q                Quick mode: short runs, for checking that the benchmarks work.\n");
+    fprintf(stderr, "  -v                Enable debug prints.\n");
+    fprintf(stderr, "  -h                Print this help message\n");
+    fprintf(stderr, "  -S solution_dir   Set the path to the source files to find the default files\n");
+    fprintf(stderr, "  -F corpus_file    Run the corpus benchmarks on the records of this file.\n");
+    fprintf(stderr, "Loopback throughput options: \n");
+    fprintf(stderr, "  -L volume_mb      Download volume_mb megabytes over loopback sockets, instead\n");
+    fprintf(stderr, "                    of running the microbenchmarks.\n");
+    fprintf(stderr, "  -N n1,n2,..       Numbers of connections sharing the volume, default 1,16,256.\n");
+    fprintf(stderr, "  -P server,client  Pin the server and client threads to these CPUs.\n");
+    fprintf(stderr, "  -c suite          Cipher suite: 128 (AES128GCM, default), 256 (AES256GCM),\n");
+    fprintf(stderr, "                    or 20 (CHACHA20_POLY1305).\n");
+    fprintf(stderr, "  -G                Do not use GSO and GRO.\n");
+    fprintf(stderr, "  -B depth          Batch up to depth messages per system call (mmsg).\n");
+    fprintf(stderr, "  -U                Use the io_uring socket loop, if available.\n");
+    fprintf(stderr, "  -b size           Socket buffer size.\n");
+    fprintf(stderr, "  -p port           Server port, default 4447.\n");
+    fprintf(stderr, "Connection scale options: \n");
+    fprintf(stderr, "  -C n1,n2,..       Ramp up n1, n2, .. simulated connections against one server,\n");
+    fprintf(stderr, "                    instead of running the microbenchmarks, e.g. 10000,100000.\n");
+    fprintf(stderr, "  -K sample         Number of connections active after the ramp, default 1000.\n");
+    fprintf(stderr, "Corpus creation options: \n");
+    fprintf(stderr, "  -R capture.pcap   Decrypt the QUIC traffic in this capture, instead of running\n");
+    fprintf(stderr, "                    the microbenchmarks. The pcapng format is not supported.\n");
+    fprintf(stderr, "  -k keylog_file    Key log file, as written with the SSLKEYLOG option.\n");
+    fprintf(stderr, "  -W corpus_file    Write the decrypted frames and header blocks to this file.\n");
+
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
+    int opt;
+    int enable_debug = 0;
+    int nb_failed = 0;
+    int do_loopback = 0;
+    int do_scale = 0;
+    char const* pcap_file = NULL;
+    char const* keylog_file = NULL;
+    char const* corpus_out = NULL;
+    char const* corpus_in = NULL;
+    bench_corpus_t corpus;
+    bench_loopback_param_t loopback_param;
+    bench_scale_param_t scale_param;
+
+    bench_loopback_default_param(&loopback_param);
+    bench_scale_default_param(&scale_param);
+    memset(&corpus, 0, sizeof(corpus));
+    memset(&bench_ctx, 0, sizeof(bench_ctx));
+    bench_ctx.nb_runs = BENCH_NB_RUNS;
+    bench_ctx.target_ns = BENCH_TARGET_NS;
+    /* Only count the allocations made inside measurements */
+    bench_ctx.is_paused = 1;
+
+    while (ret == 0 && (opt = getopt(argc, argv, "S:qvhL:N:P:c:GB:Ub:p:C:K:R:k:W:F:")) != -1) {
+        switch (opt) {
+        case 'S':
+            picoquic_set_solution_dir(optarg);
+            break;
+        case 'q':
+            bench_ctx.nb_runs = BENCH_NB_RUNS_QUICK;
+            bench_ctx.target_ns = BENCH_TARGET_NS_QUICK;
+            break;
+        case 'v':
+            enable_debug = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+            break;
+        case 'L':
+            do_loopback = 1;
+            loopback_param.volume = ((uint64_t)atoi(optarg)) * 1000000ull;
+            if (loopback_param.volume == 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'N':
+            if (bench_loopback_parse_cnx_list(&loopback_param, optarg) != 0) {
+                fprintf(stderr, "Invalid connection list: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'P':
+            if (sscanf(optarg, "%d,%d", &loopback_param.server_cpu, &loopback_param.client_cpu) != 2) {
+                fprintf(stderr, "Invalid CPU pair: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'c':
+            switch (atoi(optarg)) {
+            case 128:
+                loopback_param.cipher_suite_id = PICOQUIC_AES_128_GCM_SHA256;
+                break;
+            case 256:
+                loopback_param.cipher_suite_id = PICOQUIC_AES_256_GCM_SHA384;
+                break;
+            case 20:
+                loopback_param.cipher_suite_id = PICOQUIC_CHACHA20_POLY1305_SHA256;
+                break;
+            default:
+                fprintf(stderr, "Invalid cipher suite: %s\n", optarg);
+                ret = usage(argv[0]);
+                break;
+            }
+            break;
+        case 'G':
+            loopback_param.do_not_use_gso = 1;
+            break;
+        case 'B':
+            loopback_param.batch_depth = atoi(optarg);
+            break;
+        case 'U':
+            loopback_param.use_io_uring = 1;
+            break;
+        case 'b':
+            loopback_param.socket_buffer_size = atoi(optarg);
+            break;
+        case 'p':
+            loopback_param.server_port = (uint16_t)atoi(optarg);
+            if (loopback_param.server_port == 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'C':
+            do_scale = 1;
+            if (bench_parse_cnx_list(optarg, scale_param.nb_cnx, BENCH_SCALE_MAX_RUNS, &scale_param.nb_runs) != 0) {
+                fprintf(stderr, "Invalid connection list: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'K':
+            scale_param.nb_sample = atoi(optarg);
+            if (scale_param.nb_sample <= 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'R':
+            pcap_file = optarg;
+            break;
+        case 'k':
+            keylog_file = optarg;
+            break;
+        case 'W':
+            corpus_out = optarg;
+            break;
+        case 'F':
+            corpus_in = optarg;
+            break;
+        default:
+            ret = usage(argv[0]);
+            break;
+        }
+    }
+
+    if (ret == 0 && pcap_file != NULL && (keylog_file == NULL || corpus_out == NULL)) {
+        fprintf(stderr, "Corpus creation requires a key log file and a corpus file.\n");
+        ret = usage(argv[0]);
+    }
+
+    if (ret == 0) {
+        if (enable_debug) {
+            debug_printf_push_stream(stderr);
+        }
+        else {
+            debug_printf_suspend();
+        }
+        bench_ctx.filters = (char const**)(argv + optind);
+        bench_ctx.nb_filters = argc - optind;
+
+        if (pcap_file != NULL) {
+            ret = bench_corpus_from_pcap(pcap_file, keylog_file, corpus_out);
+        }
+        else if (corpus_in != NULL) {
+            if ((ret = bench_corpus_load(corpus_in, &corpus)) == 0) {
+                bench_ctx.corpus = &corpus;
+            }
+        }
+
+        for (size_t i = 0; ret == 0 && pcap_file == NULL && !do_loopback && !do_scale && i < nb_bench; i++) {
+            if (bench_group_is_selected(bench_table[i].bench_name) && bench_table[i].bench_fn() != 0) {
+                fprintf(stderr, "Benchmark group %s failed.\n", bench_table[i].bench_name);
+                nb_failed++;
+            }
+        }
+
+        if (ret != 0 || pcap_file != NULL) {
+            /* Corpus creation or loading done, or failed */
+        }
+        else if (do_loopback) {
+            ret = bench_loopback(&loopback_param);
+        }
+        else if (do_scale) {
+            ret = bench_scale(&scale_param);
+        }
+        else if (bench_ctx.nb_benchmarks == 0) {
+            fprintf(stderr, "No benchmark selected.\n");
+            ret = -1;
+        }
+        else if (nb_failed > 0) {
+            ret = -1;
+        }
+        bench_corpus_release(&corpus);
+        picoquic_tls_api_unload();
+    }
+
+    return (ret == 0) ? 0 : 1;
+}
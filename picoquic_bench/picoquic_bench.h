@@ -0,0 +1,111 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PICOQUIC_BENCH_H
+#define PICOQUIC_BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Utilities shared by the benchmarks */
+uint64_t bench_time_ns();
+int bench_parse_cnx_list(char const* cnx_list, int* nb_cnx, int nb_max, int* nb_values);
+
+/* Allocation accounting. The counts are only updated if the program is
+ * built with PICOQUIC_BENCH_COUNT_ALLOC, which wraps malloc and free. */
+int bench_alloc_is_counted();
+void bench_alloc_reset();
+void bench_alloc_set_counting(int is_counting);
+void bench_alloc_get(uint64_t* nb_allocs, int64_t* nb_bytes);
+
+/* End to end throughput benchmark. A server and a client run in two
+ * network threads, using the production socket loop over the loopback
+ * interface. The client opens nb_cnx connections and downloads the total
+ * volume, split evenly between them. The benchmark is repeated for each
+ * of the connection counts in the list. */
+#define BENCH_LOOPBACK_MAX_RUNS 16
+
+typedef struct st_bench_loopback_param_t {
+    uint64_t volume;
+    int nb_cnx[BENCH_LOOPBACK_MAX_RUNS];
+    int nb_runs;
+    int server_cpu; /* -1 if not pinned */
+    int client_cpu; /* -1 if not pinned */
+    int cipher_suite_id;
+    uint16_t server_port;
+    int do_not_use_gso;
+    int batch_depth;
+    int use_io_uring;
+    int socket_buffer_size;
+} bench_loopback_param_t;
+
+void bench_loopback_default_param(bench_loopback_param_t* param);
+int bench_loopback_parse_cnx_list(bench_loopback_param_t* param, char const* cnx_list);
+int bench_loopback(bench_loopback_param_t* param);
+
+/* Connection scale benchmark. A client context ramps up nb_cnx connections
+ * against one server context, over simulated links and in simulated time.
+ * The benchmark reports the server memory per connection, the server cost
+ * per packet once all connections are established, and the cost of the
+ * wake list and connection table operations. It is repeated for each of
+ * the connection counts in the list, so that costs growing with the number
+ * of connections show up in the results. */
+#define BENCH_SCALE_MAX_RUNS 8
+
+typedef struct st_bench_scale_param_t {
+    int nb_cnx[BENCH_SCALE_MAX_RUNS];
+    int nb_runs;
+    int nb_sample; /* number of connections active in the per packet measurement */
+    int nb_lookups; /* number of operations in the table measurements */
+} bench_scale_param_t;
+
+void bench_scale_default_param(bench_scale_param_t* param);
+int bench_scale(bench_scale_param_t* param);
+
+/* Frame corpus extracted from packet captures. The converter decrypts the
+ * 1-RTT packets found in a pcap file with the secrets of an SSLKEYLOG file,
+ * and saves the decrypted frames and the HTTP/3 header blocks. The corpus
+ * benchmarks replay these records instead of synthetic frames. */
+#define BENCH_CORPUS_RECORD_FRAMES 1 /* payload of a 1-RTT packet */
+#define BENCH_CORPUS_RECORD_HEADERS 2 /* QPACK header block of an HTTP/3 HEADERS frame */
+
+typedef struct st_bench_corpus_record_t {
+    uint64_t record_type;
+    const uint8_t* data;
+    size_t length;
+} bench_corpus_record_t;
+
+typedef struct st_bench_corpus_t {
+    uint8_t* buffer;
+    bench_corpus_record_t* records;
+    size_t nb_records;
+} bench_corpus_t;
+
+int bench_corpus_from_pcap(char const* pcap_file, char const* keylog_file, char const* corpus_file);
+int bench_corpus_load(char const* corpus_file, bench_corpus_t* corpus);
+void bench_corpus_release(bench_corpus_t* corpus);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_BENCH_H */
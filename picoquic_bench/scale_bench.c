@@ -0,0 +1,498 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Connection scale benchmark.
+*
+* A client context ramps up a large number of connections against a single
+* server context. The two contexts exchange packets over simulated links,
+* in simulated time, but the cost of the server calls is measured in real
+* time. Each client connection uses its own address and port, so that the
+* server tables look like those of a server with as many clients.
+*
+* The benchmark reports, for each connection count:
+* - the wall clock duration of the ramp, and the handshake rate;
+* - the net memory allocated by the server calls during the ramp, divided
+*   by the number of connections (only when allocations are counted);
+* - the server cost per packet when a sample of the connections exchange
+*   PING frames after the ramp;
+* - the cost of finding the next connection to wake, of moving a connection
+*   in the wake list, and of finding a connection by CID or by address.
+*
+* With costs that do not depend on the number of connections, the values
+* should stay about the same as the connection count grows.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "picoquictest_internal.h"
+#include "picoquic_bench.h"
+
+#define BENCH_SCALE_ALPN "picoquic-bench"
+#define BENCH_SCALE_CREATION_INTERVAL 20 /* microseconds between new connections */
+#define BENCH_SCALE_SETTLE_TIME 1000000 /* time to settle after the ramp */
+#define BENCH_SCALE_SAMPLE_TIME 100000 /* duration of the per packet measurement */
+#define BENCH_SCALE_PORTS_PER_ADDR 60000
+
+typedef struct st_bench_scale_ctx_t {
+    picoquic_quic_t* qclient;
+    picoquic_quic_t* qserver;
+    picoquictest_sim_link_t* link_to_server;
+    picoquictest_sim_link_t* link_to_client;
+    struct sockaddr_in server_addr;
+    uint64_t simulated_time;
+    int nb_cnx;
+    int nb_created;
+    int nb_ready;
+    uint64_t next_creation_time;
+    picoquic_cnx_t** client_cnx;
+    /* Measurement of the server calls */
+    uint64_t server_ns;
+    uint64_t server_packets;
+} bench_scale_ctx_t;
+
+void bench_scale_default_param(bench_scale_param_t* param)
+{
+    memset(param, 0, sizeof(bench_scale_param_t));
+    param->nb_cnx[0] = 10000;
+    param->nb_cnx[1] = 100000;
+    param->nb_runs = 2;
+    param->nb_sample = 1000;
+    param->nb_lookups = 1000000;
+}
+
+static int bench_scale_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+    bench_scale_ctx_t* ctx = (bench_scale_ctx_t*)callback_ctx;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(v_stream_ctx);
+#endif
+
+    if (fin_or_event == picoquic_callback_ready && picoquic_is_client(cnx)) {
+        ctx->nb_ready++;
+    }
+
+    return 0;
+}
+
+static int bench_scale_create_client(bench_scale_ctx_t* ctx)
+{
+    int ret = 0;
+    struct sockaddr_in client_addr;
+    picoquic_cnx_t* cnx;
+    int rank = ctx->nb_created;
+
+    picoquic_set_test_address(&client_addr,
+        htonl(0x0a000000 + (uint32_t)(rank / BENCH_SCALE_PORTS_PER_ADDR)),
+        htons((uint16_t)(1024 + rank % BENCH_SCALE_PORTS_PER_ADDR)));
+
+    cnx = picoquic_create_cnx(ctx->qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&ctx->server_addr, ctx->simulated_time, 0, PICOQUIC_TEST_SNI, BENCH_SCALE_ALPN, 1);
+    if (cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_store_addr(&cnx->path[0]->first_tuple->local_addr, (struct sockaddr*)&client_addr);
+        ctx->client_cnx[rank] = cnx;
+        ctx->nb_created++;
+        ret = picoquic_start_client_cnx(cnx);
+    }
+
+    return ret;
+}
+
+static int bench_scale_arrival(bench_scale_ctx_t* ctx, picoquic_quic_t* quic, picoquictest_sim_link_t* link)
+{
+    int ret = 0;
+    picoquictest_sim_packet_t* packet = picoquictest_sim_link_dequeue(link, ctx->simulated_time);
+
+    if (packet != NULL) {
+        int is_server = (quic == ctx->qserver);
+        uint64_t start_ns = 0;
+        picoquic_cnx_t* first_cnx = NULL;
+
+        if (is_server) {
+            start_ns = bench_time_ns();
+            bench_alloc_set_counting(1);
+        }
+        ret = picoquic_incoming_packet_ex(quic, packet->bytes, packet->length,
+            (struct sockaddr*)&packet->addr_from, (struct sockaddr*)&packet->addr_to, 0,
+            packet->ecn_mark, &first_cnx, ctx->simulated_time);
+        if (is_server) {
+            bench_alloc_set_counting(0);
+            ctx->server_ns += bench_time_ns() - start_ns;
+            ctx->server_packets++;
+        }
+        free(packet);
+    }
+
+    return ret;
+}
+
+static int bench_scale_prepare(bench_scale_ctx_t* ctx, picoquic_quic_t* quic, picoquictest_sim_link_t* link)
+{
+    int ret = 0;
+    picoquictest_sim_packet_t* packet = picoquictest_sim_link_create_packet();
+
+    if (packet == NULL) {
+        ret = -1;
+    }
+    else {
+        int is_server = (quic == ctx->qserver);
+        int if_index = 0;
+        uint64_t start_ns = 0;
+        picoquic_cnx_t* last_cnx = NULL;
+
+        packet->addr_from.ss_family = 0;
+        if (is_server) {
+            start_ns = bench_time_ns();
+            bench_alloc_set_counting(1);
+        }
+        ret = picoquic_prepare_next_packet_ex(quic, ctx->simulated_time,
+            packet->bytes, sizeof(packet->bytes), &packet->length,
+            &packet->addr_to, &packet->addr_from, &if_index, NULL, &last_cnx, NULL);
+        if (is_server) {
+            bench_alloc_set_counting(0);
+            ctx->server_ns += bench_time_ns() - start_ns;
+        }
+
+        if (ret == 0 && packet->length > 0) {
+            if (is_server) {
+                ctx->server_packets++;
+                if (packet->addr_from.ss_family == 0) {
+                    picoquic_store_addr(&packet->addr_from, (struct sockaddr*)&ctx->server_addr);
+                }
+            }
+            picoquictest_sim_link_submit(link, packet, ctx->simulated_time);
+        }
+        else {
+            free(packet);
+        }
+    }
+
+    return ret;
+}
+
+/* Execute the next event before the horizon, or report that there is none */
+static int bench_scale_step(bench_scale_ctx_t* ctx, uint64_t horizon, int* is_done)
+{
+    int ret = 0;
+    enum {
+        bench_scale_event_none = 0,
+        bench_scale_event_create,
+        bench_scale_event_client_arrival,
+        bench_scale_event_client_prepare,
+        bench_scale_event_server_arrival,
+        bench_scale_event_server_prepare
+    } next_event = bench_scale_event_none;
+    uint64_t next_time = horizon;
+    uint64_t t;
+
+    if (ctx->nb_created < ctx->nb_cnx && ctx->next_creation_time < next_time) {
+        next_time = ctx->next_creation_time;
+        next_event = bench_scale_event_create;
+    }
+    if ((t = picoquictest_sim_link_next_arrival(ctx->link_to_client, next_time)) < next_time) {
+        next_time = t;
+        next_event = bench_scale_event_client_arrival;
+    }
+    if ((t = picoquic_get_next_wake_time(ctx->qclient, ctx->simulated_time)) < next_time) {
+        next_time = t;
+        next_event = bench_scale_event_client_prepare;
+    }
+    if ((t = picoquictest_sim_link_next_arrival(ctx->link_to_server, next_time)) < next_time) {
+        next_time = t;
+        next_event = bench_scale_event_server_arrival;
+    }
+    if ((t = picoquic_get_next_wake_time(ctx->qserver, ctx->simulated_time)) < next_time) {
+        next_time = t;
+        next_event = bench_scale_event_server_prepare;
+    }
+    if (next_time > ctx->simulated_time) {
+        ctx->simulated_time = next_time;
+    }
+
+    switch (next_event) {
+    case bench_scale_event_create:
+        ret = bench_scale_create_client(ctx);
+        ctx->next_creation_time += BENCH_SCALE_CREATION_INTERVAL;
+        break;
+    case bench_scale_event_client_arrival:
+        ret = bench_scale_arrival(ctx, ctx->qclient, ctx->link_to_client);
+        break;
+    case bench_scale_event_client_prepare:
+        ret = bench_scale_prepare(ctx, ctx->qclient, ctx->link_to_server);
+        break;
+    case bench_scale_event_server_arrival:
+        ret = bench_scale_arrival(ctx, ctx->qserver, ctx->link_to_server);
+        break;
+    case bench_scale_event_server_prepare:
+        ret = bench_scale_prepare(ctx, ctx->qserver, ctx->link_to_client);
+        break;
+    default:
+        *is_done = 1;
+        break;
+    }
+
+    return ret;
+}
+
+static int bench_scale_run_until(bench_scale_ctx_t* ctx, uint64_t horizon)
+{
+    int ret = 0;
+    int is_done = 0;
+
+    while (ret == 0 && !is_done) {
+        ret = bench_scale_step(ctx, horizon, &is_done);
+    }
+
+    return ret;
+}
+
+static void bench_scale_delete_ctx(bench_scale_ctx_t* ctx)
+{
+    if (ctx->qclient != NULL) {
+        picoquic_free(ctx->qclient);
+    }
+    if (ctx->qserver != NULL) {
+        picoquic_free(ctx->qserver);
+    }
+    if (ctx->link_to_server != NULL) {
+        picoquictest_sim_link_delete(ctx->link_to_server);
+    }
+    if (ctx->link_to_client != NULL) {
+        picoquictest_sim_link_delete(ctx->link_to_client);
+    }
+    if (ctx->client_cnx != NULL) {
+        free(ctx->client_cnx);
+    }
+    memset(ctx, 0, sizeof(bench_scale_ctx_t));
+}
+
+static int bench_scale_init_ctx(bench_scale_ctx_t* ctx, int nb_cnx)
+{
+    int ret = 0;
+    char test_server_cert_file[512];
+    char test_server_key_file[512];
+
+    memset(ctx, 0, sizeof(bench_scale_ctx_t));
+    ctx->nb_cnx = nb_cnx;
+    picoquic_set_test_address(&ctx->server_addr, htonl(0x0a010001), htons(443));
+
+    if (picoquic_get_input_path(test_server_cert_file, sizeof(test_server_cert_file),
+        picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT) != 0 ||
+        picoquic_get_input_path(test_server_key_file, sizeof(test_server_key_file),
+            picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY) != 0) {
+        fprintf(stderr, "Cannot find the server certificate, check the solution dir.\n");
+        ret = -1;
+    }
+    else if ((ctx->client_cnx = (picoquic_cnx_t**)calloc(nb_cnx, sizeof(picoquic_cnx_t*))) == NULL ||
+        (ctx->qclient = picoquic_create(nb_cnx, NULL, NULL, NULL, BENCH_SCALE_ALPN,
+            bench_scale_callback, ctx, NULL, NULL, NULL, ctx->simulated_time, &ctx->simulated_time,
+            NULL, NULL, 0)) == NULL ||
+        (ctx->qserver = picoquic_create(nb_cnx, test_server_cert_file, test_server_key_file, NULL, BENCH_SCALE_ALPN,
+            bench_scale_callback, ctx, NULL, NULL, NULL, ctx->simulated_time, &ctx->simulated_time,
+            NULL, NULL, 0)) == NULL ||
+        (ctx->link_to_server = picoquictest_sim_link_create(10.0, 1000, NULL, 0, 0)) == NULL ||
+        (ctx->link_to_client = picoquictest_sim_link_create(10.0, 1000, NULL, 0, 0)) == NULL) {
+        fprintf(stderr, "Cannot create the contexts for %d connections.\n", nb_cnx);
+        ret = -1;
+    }
+    else {
+        /* The connections stay idle after the ramp, they should not time out */
+        picoquic_set_default_idle_timeout(ctx->qclient, 0);
+        picoquic_set_default_idle_timeout(ctx->qserver, 0);
+        ret = picoquic_set_low_memory_mode(ctx->qclient, 1);
+        if (ret == 0) {
+            ret = picoquic_set_low_memory_mode(ctx->qserver, 1);
+        }
+    }
+
+    return ret;
+}
+
+static double bench_scale_per_op(uint64_t total, uint64_t nb_ops)
+{
+    return (nb_ops == 0) ? 0.0 : ((double)total) / ((double)nb_ops);
+}
+
+/* Measure the wake list and table operations on the established server connections */
+static int bench_scale_tables(bench_scale_ctx_t* ctx, int nb_lookups,
+    double* wake_ns, double* reinsert_ns, double* cid_ns, double* net_ns)
+{
+    int ret = 0;
+    size_t nb_server_cnx = 0;
+    picoquic_cnx_t** server_cnx = (picoquic_cnx_t**)calloc(ctx->nb_cnx, sizeof(picoquic_cnx_t*));
+
+    if (server_cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_cnx_t* cnx = picoquic_get_first_cnx(ctx->qserver);
+        uint64_t random_ctx = 0xbe4c85ca1eull;
+        uint64_t start_ns;
+        int nb_found = 0;
+
+        while (cnx != NULL && nb_server_cnx < (size_t)ctx->nb_cnx) {
+            server_cnx[nb_server_cnx++] = cnx;
+            cnx = picoquic_get_next_cnx(cnx);
+        }
+        if (nb_server_cnx == 0) {
+            ret = -1;
+        }
+        else {
+            start_ns = bench_time_ns();
+            for (int i = 0; i < nb_lookups; i++) {
+                (void)picoquic_get_earliest_cnx_to_wake(ctx->qserver, UINT64_MAX);
+            }
+            *wake_ns = bench_scale_per_op(bench_time_ns() - start_ns, nb_lookups);
+
+            /* Move a random connection later in the wake list, then back to its place */
+            start_ns = bench_time_ns();
+            for (int i = 0; i < nb_lookups / 2; i++) {
+                cnx = server_cnx[picoquic_test_uniform_random(&random_ctx, nb_server_cnx)];
+                uint64_t next_wake_time = cnx->next_wake_time;
+                picoquic_reinsert_by_wake_time(ctx->qserver, cnx, next_wake_time + 1000000);
+                picoquic_reinsert_by_wake_time(ctx->qserver, cnx, next_wake_time);
+            }
+            *reinsert_ns = bench_scale_per_op(bench_time_ns() - start_ns, 2 * (uint64_t)(nb_lookups / 2));
+
+            start_ns = bench_time_ns();
+            for (int i = 0; i < nb_lookups; i++) {
+                cnx = server_cnx[picoquic_test_uniform_random(&random_ctx, nb_server_cnx)];
+                nb_found += (picoquic_cnx_by_id(ctx->qserver, picoquic_get_local_cnxid(cnx), NULL) == cnx);
+            }
+            *cid_ns = bench_scale_per_op(bench_time_ns() - start_ns, nb_lookups);
+
+            start_ns = bench_time_ns();
+            for (int i = 0; i < nb_lookups; i++) {
+                cnx = server_cnx[picoquic_test_uniform_random(&random_ctx, nb_server_cnx)];
+                nb_found += (picoquic_cnx_by_net(ctx->qserver,
+                    (struct sockaddr*)&cnx->path[0]->first_tuple->peer_addr) == cnx);
+            }
+            *net_ns = bench_scale_per_op(bench_time_ns() - start_ns, nb_lookups);
+
+            if (nb_found < 2 * nb_lookups) {
+                fprintf(stderr, "Only %d of %d lookups succeeded.\n", nb_found, 2 * nb_lookups);
+                ret = -1;
+            }
+        }
+        free(server_cnx);
+    }
+
+    return ret;
+}
+
+static int bench_scale_one(bench_scale_param_t* param, int nb_cnx)
+{
+    int ret = 0;
+    bench_scale_ctx_t ctx;
+    uint64_t ramp_ns = 0;
+    uint64_t nb_allocs = 0;
+    int64_t nb_bytes = 0;
+    uint64_t sample_packets = 0;
+    uint64_t sample_ns = 0;
+    double wake_ns = 0;
+    double reinsert_ns = 0;
+    double cid_ns = 0;
+    double net_ns = 0;
+
+    if ((ret = bench_scale_init_ctx(&ctx, nb_cnx)) == 0) {
+        uint64_t start_ns = bench_time_ns();
+        int is_done = 0;
+
+        /* Ramp up the connections, then let the handshakes settle */
+        bench_alloc_reset();
+        while (ret == 0 && !is_done && ctx.nb_ready < nb_cnx) {
+            ret = bench_scale_step(&ctx, UINT64_MAX, &is_done);
+        }
+        if (ret == 0 && ctx.nb_ready < nb_cnx) {
+            fprintf(stderr, "Only %d connections of %d are ready.\n", ctx.nb_ready, nb_cnx);
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = bench_scale_run_until(&ctx, ctx.simulated_time + BENCH_SCALE_SETTLE_TIME);
+        }
+        ramp_ns = bench_time_ns() - start_ns;
+        bench_alloc_get(&nb_allocs, &nb_bytes);
+    }
+
+    if (ret == 0) {
+        /* A sample of the clients send a PING, the server acknowledges it */
+        int nb_sample = (param->nb_sample < nb_cnx) ? param->nb_sample : nb_cnx;
+        const uint8_t ping_frame[1] = { picoquic_frame_type_ping };
+
+        for (int i = 0; ret == 0 && i < nb_sample; i++) {
+            picoquic_cnx_t* cnx = ctx.client_cnx[(int)(((int64_t)i * nb_cnx) / nb_sample)];
+            ret = picoquic_queue_misc_frame(cnx, ping_frame, sizeof(ping_frame), 0, picoquic_packet_context_application);
+            picoquic_reinsert_by_wake_time(ctx.qclient, cnx, ctx.simulated_time);
+        }
+        ctx.server_ns = 0;
+        ctx.server_packets = 0;
+        if (ret == 0) {
+            ret = bench_scale_run_until(&ctx, ctx.simulated_time + BENCH_SCALE_SAMPLE_TIME);
+        }
+        sample_ns = ctx.server_ns;
+        sample_packets = ctx.server_packets;
+    }
+
+    if (ret == 0) {
+        ret = bench_scale_tables(&ctx, param->nb_lookups, &wake_ns, &reinsert_ns, &cid_ns, &net_ns);
+    }
+
+    if (ret == 0) {
+        printf("%8d cnx: ramp %.2fs (%.0f hs/s), ", nb_cnx, ((double)ramp_ns) / 1000000000.0,
+            bench_scale_per_op((uint64_t)nb_cnx * 1000000000ull, ramp_ns));
+        if (bench_alloc_is_counted()) {
+            printf("server %.0f B/cnx, %.1f allocs/cnx, ",
+                ((double)nb_bytes) / ((double)nb_cnx), bench_scale_per_op(nb_allocs, nb_cnx));
+        }
+        else {
+            printf("server n/a B/cnx, ");
+        }
+        printf("%.0f ns/pkt (%" PRIu64 " pkts), wake %.1f ns, reinsert %.1f ns, cid %.1f ns, addr %.1f ns\n",
+            bench_scale_per_op(sample_ns, sample_packets), sample_packets,
+            wake_ns, reinsert_ns, cid_ns, net_ns);
+    }
+
+    bench_scale_delete_ctx(&ctx);
+
+    return ret;
+}
+
+int bench_scale(bench_scale_param_t* param)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < param->nb_runs; i++) {
+        ret = bench_scale_one(param, param->nb_cnx[i]);
+    }
+
+    return ret;
+}
@@ -0,0 +1,310 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Parameter sweep over picoquic_ns simulations.
+*
+* The program runs one simulation for each combination of the parameter
+* values given on the command line, spreading the simulations over several
+* threads, and writes one CSV line per combination. For example, the
+* following command compares cubic and bbr over three latencies and two
+* loss rates, on 8 threads:
+*
+*     picoquic_ns_sweep -S <solution_dir> -a cubic,bbr -l 5000,20000,100000
+*         -L 0,1000 -T 8 -o sweep.csv
+*
+* Latencies, jitters and queue delays are in microseconds, data rates in
+* Mbps, and the loss interval is the number of packets sent between two
+* losses, 0 meaning no loss.
+*/
+
+#ifdef _WINDOWS
+#include "getopt.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "picoquic_ns.h"
+
+#define NS_SWEEP_MAX_VALUES 64
+
+static char const* ns_sweep_default_scenario = "=b1:*1:397:4000000;";
+
+typedef struct st_ns_sweep_values_t {
+    picoquic_congestion_algorithm_t const* cc_algos[NS_SWEEP_MAX_VALUES];
+    double data_rates[NS_SWEEP_MAX_VALUES];
+    uint64_t latencies[NS_SWEEP_MAX_VALUES];
+    uint64_t jitters[NS_SWEEP_MAX_VALUES];
+    uint64_t loss_intervals[NS_SWEEP_MAX_VALUES];
+    uint64_t queue_delays[NS_SWEEP_MAX_VALUES];
+} ns_sweep_values_t;
+
+static int ns_sweep_parse_list(char const* list, uint64_t* values, size_t* nb_values)
+{
+    int ret = 0;
+    size_t nb = 0;
+
+    while (ret == 0 && *list != 0) {
+        char* end = NULL;
+        uint64_t v = strtoull(list, &end, 10);
+
+        if (end == list || nb >= NS_SWEEP_MAX_VALUES) {
+            ret = -1;
+        }
+        else {
+            values[nb++] = v;
+            list = end;
+            if (*list == ',') {
+                list++;
+            }
+            else if (*list != 0) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret == 0) {
+        *nb_values = nb;
+    }
+
+    return (nb == 0) ? -1 : ret;
+}
+
+static int ns_sweep_parse_rates(char const* list, double* rates, size_t* nb_values)
+{
+    int ret = 0;
+    size_t nb = 0;
+
+    while (ret == 0 && *list != 0) {
+        char* end = NULL;
+        double mbps = strtod(list, &end);
+
+        if (end == list || mbps <= 0 || nb >= NS_SWEEP_MAX_VALUES) {
+            ret = -1;
+        }
+        else {
+            rates[nb++] = mbps / 1000.0;
+            list = end;
+            if (*list == ',') {
+                list++;
+            }
+            else if (*list != 0) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret == 0) {
+        *nb_values = nb;
+    }
+
+    return (nb == 0) ? -1 : ret;
+}
+
+static int ns_sweep_parse_cc_list(char const* list, picoquic_congestion_algorithm_t const** cc_algos, size_t* nb_values)
+{
+    int ret = 0;
+    size_t nb = 0;
+
+    while (ret == 0 && *list != 0) {
+        char cc_id[32];
+        size_t len = 0;
+
+        while (list[len] != 0 && list[len] != ',') {
+            len++;
+        }
+        if (len == 0 || len >= sizeof(cc_id) || nb >= NS_SWEEP_MAX_VALUES) {
+            ret = -1;
+        }
+        else {
+            memcpy(cc_id, list, len);
+            cc_id[len] = 0;
+            if ((cc_algos[nb] = picoquic_get_congestion_algorithm(cc_id)) == NULL) {
+                fprintf(stderr, "Unknown congestion control algorithm: %s\n", cc_id);
+                ret = -1;
+            }
+            else {
+                nb++;
+                list += len;
+                if (*list == ',') {
+                    list++;
+                }
+            }
+        }
+    }
+    if (ret == 0) {
+        *nb_values = nb;
+    }
+
+    return (nb == 0) ? -1 : ret;
+}
+
+static int usage(char const* argv0)
+{
+    fprintf(stderr, "PicoQUIC network simulation sweep\n");
+    fprintf(stderr, "Usage: %s [-S solution_dir] [options]\n\n", argv0);
+    fprintf(stderr, "Runs one simulation per combination of the listed values, and writes\n");
+    fprintf(stderr, "the results in CSV format. Lists are comma separated.\n");
+    fprintf(stderr, "Options: \n");
+    fprintf(stderr, "  -a cc1,cc2,..     Congestion control algorithms of the main connection.\n");
+    fprintf(stderr, "  -r r1,r2,..       Data rates, Mbps, default 10.\n");
+    fprintf(stderr, "  -l l1,l2,..       One way latencies, microseconds, default 10000.\n");
+    fprintf(stderr, "  -j j1,j2,..       Jitters, microseconds, default 0.\n");
+    fprintf(stderr, "  -L n1,n2,..       Packets sent between two losses, 0 for no loss.\n");
+    fprintf(stderr, "  -q q1,q2,..       Maximum queue delays, microseconds.\n");
+    fprintf(stderr, "  -s scenario       Quicperf scenario of the main connection.\n");
+    fprintf(stderr, "  -b scenario       Quicperf scenario of the background connections.\n");
+    fprintf(stderr, "  -n number         Total number of connections, default 1.\n");
+    fprintf(stderr, "  -t time           Maximum simulated time of a run, microseconds, default 60s.\n");
+    fprintf(stderr, "  -T threads        Number of worker threads, default 1.\n");
+    fprintf(stderr, "  -o file.csv       Write the results in this file instead of stdout.\n");
+    fprintf(stderr, "  -S solution_dir   Set the path to the source files to find the default files\n");
+    fprintf(stderr, "  -h                Print this help message\n");
+
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
+    int opt;
+    char const* csv_file = NULL;
+    FILE* F = NULL;
+    picoquic_ns_sweep_t sweep;
+    ns_sweep_values_t values;
+
+    memset(&sweep, 0, sizeof(sweep));
+    memset(&values, 0, sizeof(values));
+    sweep.cc_algos = values.cc_algos;
+    sweep.data_rates_in_gbps = values.data_rates;
+    sweep.latencies = values.latencies;
+    sweep.jitters = values.jitters;
+    sweep.loss_intervals = values.loss_intervals;
+    sweep.queue_delays = values.queue_delays;
+    sweep.nb_threads = 1;
+    sweep.base_spec.main_scenario_text = ns_sweep_default_scenario;
+    sweep.base_spec.background_scenario_text = ns_sweep_default_scenario;
+    sweep.base_spec.nb_connections = 1;
+    sweep.base_spec.main_target_time = 60000000;
+
+    picoquic_register_all_congestion_control_algorithms();
+
+    while (ret == 0 && (opt = getopt(argc, argv, "S:a:r:l:j:L:q:s:b:n:t:T:o:h")) != -1) {
+        switch (opt) {
+        case 'S':
+            picoquic_set_solution_dir(optarg);
+            break;
+        case 'a':
+            if (ns_sweep_parse_cc_list(optarg, values.cc_algos, &sweep.nb_cc_algos) != 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'r':
+            if (ns_sweep_parse_rates(optarg, values.data_rates, &sweep.nb_data_rates) != 0) {
+                fprintf(stderr, "Invalid data rates: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'l':
+            if (ns_sweep_parse_list(optarg, values.latencies, &sweep.nb_latencies) != 0) {
+                fprintf(stderr, "Invalid latencies: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'j':
+            if (ns_sweep_parse_list(optarg, values.jitters, &sweep.nb_jitters) != 0) {
+                fprintf(stderr, "Invalid jitters: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'L':
+            if (ns_sweep_parse_list(optarg, values.loss_intervals, &sweep.nb_loss_intervals) != 0) {
+                fprintf(stderr, "Invalid loss intervals: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'q':
+            if (ns_sweep_parse_list(optarg, values.queue_delays, &sweep.nb_queue_delays) != 0) {
+                fprintf(stderr, "Invalid queue delays: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            break;
+        case 's':
+            sweep.base_spec.main_scenario_text = optarg;
+            break;
+        case 'b':
+            sweep.base_spec.background_scenario_text = optarg;
+            break;
+        case 'n':
+            sweep.base_spec.nb_connections = atoi(optarg);
+            if (sweep.base_spec.nb_connections <= 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 't':
+            sweep.base_spec.main_target_time = strtoull(optarg, NULL, 10);
+            if (sweep.base_spec.main_target_time == 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'T':
+            sweep.nb_threads = atoi(optarg);
+            if (sweep.nb_threads <= 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'o':
+            csv_file = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+            break;
+        default:
+            ret = usage(argv[0]);
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        debug_printf_suspend();
+
+        if (csv_file == NULL) {
+            F = stdout;
+        }
+        else if ((F = picoquic_file_open(csv_file, "w")) == NULL) {
+            fprintf(stderr, "Cannot open %s\n", csv_file);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        fprintf(stderr, "Running %zu simulations on %d threads.\n",
+            picoquic_ns_sweep_size(&sweep), sweep.nb_threads);
+        ret = picoquic_ns_sweep(&sweep, F, stderr);
+        if (F != stdout) {
+            (void)picoquic_file_close(F);
+        }
+    }
+
+    return (ret == 0) ? 0 : 1;
+}
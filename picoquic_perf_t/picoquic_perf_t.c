@@ -0,0 +1,479 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* Performance and stress tests.
+*
+* This program runs the long tests of the PerfAndStressTest project, which
+* are not part of the regular unit test runs, and measures the wall clock
+* time and the CPU time of each test. The tests run simulations, so each
+* test always processes the same amount of data: the CPU time of the test
+* is a proxy for the CPU cost per byte, and the wall clock time for the
+* inverse of the throughput.
+*
+* The results can be written to a JSON file with "-w", and compared to a
+* baseline produced by a previous run with "-b". The program then fails if
+* a test fails, or if its CPU time or its wall clock time exceeds the
+* baseline by more than the threshold. Short tests are not compared, as
+* their measurements are too noisy. The baseline reader only parses the
+* files written by this program, with one test per line.
+*/
+
+#ifdef _WINDOWS
+#include "getopt.h"
+#include <Windows.h>
+#endif
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "picoquictest.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PERF_TEST_DEFAULT_THRESHOLD 20 /* percent */
+#define PERF_TEST_DEFAULT_MIN_TIME 50000 /* microseconds */
+
+typedef struct st_picoquic_test_def_t {
+    char const* test_name;
+    int (*test_fn)();
+} picoquic_test_def_t;
+
+typedef enum {
+    test_not_run = 0,
+    test_excluded,
+    test_success,
+    test_failed
+} test_status_t;
+
+typedef struct st_perf_test_result_t {
+    test_status_t status;
+    uint64_t wall_us;
+    uint64_t cpu_us;
+    int has_baseline;
+    uint64_t baseline_wall_us;
+    uint64_t baseline_cpu_us;
+} perf_test_result_t;
+
+static const picoquic_test_def_t test_table[] = {
+    { "satellite_basic", satellite_basic_test },
+    { "satellite_seeded", satellite_seeded_test },
+    { "satellite_seeded_bbr1", satellite_seeded_bbr1_test },
+    { "satellite_loss", satellite_loss_test },
+    { "satellite_loss_fc", satellite_loss_fc_test },
+    { "satellite_jitter", satellite_jitter_test },
+    { "satellite_medium", satellite_medium_test },
+    { "satellite_preemptive", satellite_preemptive_test },
+    { "satellite_preemptive_fc", satellite_preemptive_fc_test },
+    { "satellite_small", satellite_small_test },
+    { "satellite_small_up", satellite_small_up_test },
+    { "satellite_bbr1", satellite_bbr1_test },
+    { "satellite_cubic", satellite_cubic_test },
+    { "satellite_cubic_seed", satellite_cubic_seeded_test },
+    { "satellite_cubic_loss", satellite_cubic_loss_test },
+    { "satellite_dcubic_seed", satellite_dcubic_seeded_test },
+    { "satellite_prague_seed", satellite_prague_seeded_test },
+    { "bdp_basic", bdp_basic_test },
+    { "bdp_delay", bdp_delay_test },
+    { "bdp_ip", bdp_ip_test },
+    { "bdp_rtt", bdp_rtt_test },
+    { "bdp_reno", bdp_reno_test },
+    { "bdp_cubic", bdp_cubic_test },
+    { "bdp_short", bdp_short_test },
+    { "bdp_short_hi", bdp_short_hi_test },
+    { "bdp_short_lo", bdp_short_lo_test },
+    { "stress", stress_test },
+    { "http_stress", http_stress_test },
+    { "http_corrupt", http_corrupt_test },
+    { "http_corrupt_rdpn", http_corrupt_rdpn_test },
+    { "fuzz", fuzz_test },
+    { "fuzz_initial", fuzz_initial_test },
+    { "cnx_stress", cnx_stress_unit_test },
+    { "cnx_ddos", cnx_ddos_unit_test }
+};
+
+static size_t const nb_tests = sizeof(test_table) / sizeof(picoquic_test_def_t);
+
+static uint64_t perf_cpu_time_us()
+{
+#ifdef _WINDOWS
+    FILETIME creation_time;
+    FILETIME exit_time;
+    FILETIME kernel_time;
+    FILETIME user_time;
+    uint64_t cpu_100ns = 0;
+
+    if (GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+        cpu_100ns = (((uint64_t)kernel_time.dwHighDateTime) << 32) + kernel_time.dwLowDateTime +
+            (((uint64_t)user_time.dwHighDateTime) << 32) + user_time.dwLowDateTime;
+    }
+    return cpu_100ns / 10;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ((uint64_t)ts.tv_sec) * 1000000ull + ((uint64_t)ts.tv_nsec) / 1000;
+#endif
+}
+
+/* Run the test nb_runs times, and keep the lowest times */
+static int do_one_test(size_t i, int nb_runs, perf_test_result_t* result, FILE* F)
+{
+    int ret = 0;
+
+    fprintf(F, "Starting test number %" PRIst ", %s\n", i, test_table[i].test_name);
+    fflush(F);
+
+    for (int r = 0; ret == 0 && r < nb_runs; r++) {
+        uint64_t start_wall = picoquic_current_time();
+        uint64_t start_cpu = perf_cpu_time_us();
+        uint64_t wall_us;
+        uint64_t cpu_us;
+
+        ret = test_table[i].test_fn();
+        wall_us = picoquic_current_time() - start_wall;
+        cpu_us = perf_cpu_time_us() - start_cpu;
+        if (r == 0 || wall_us < result->wall_us) {
+            result->wall_us = wall_us;
+        }
+        if (r == 0 || cpu_us < result->cpu_us) {
+            result->cpu_us = cpu_us;
+        }
+    }
+
+    if (ret == 0) {
+        fprintf(F, "    Success, wall %" PRIu64 " us, cpu %" PRIu64 " us.\n", result->wall_us, result->cpu_us);
+    }
+    else {
+        fprintf(F, "    Fails, error: %d.\n", ret);
+    }
+    fflush(F);
+
+    return ret;
+}
+
+static int get_test_number(char const* test_name)
+{
+    int test_number = -1;
+
+    for (size_t i = 0; i < nb_tests; i++) {
+        if (strcmp(test_name, test_table[i].test_name) == 0) {
+            test_number = (int)i;
+        }
+    }
+
+    return test_number;
+}
+
+static int perf_write_json(char const* file_name, perf_test_result_t* results)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_name, "w");
+    int is_first = 1;
+
+    if (F == NULL) {
+        fprintf(stderr, "Cannot open %s\n", file_name);
+        ret = -1;
+    }
+    else {
+        fprintf(F, "{\n  \"tests\": [");
+        for (size_t i = 0; i < nb_tests; i++) {
+            if (results[i].status == test_success || results[i].status == test_failed) {
+                fprintf(F, "%s\n    { \"name\": \"%s\", \"ret\": %d, \"wall_us\": %" PRIu64 ", \"cpu_us\": %" PRIu64 " }",
+                    (is_first) ? "" : ",", test_table[i].test_name, (results[i].status == test_success) ? 0 : -1,
+                    results[i].wall_us, results[i].cpu_us);
+                is_first = 0;
+            }
+        }
+        fprintf(F, "\n  ]\n}\n");
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+static int perf_json_get_number(char const* line, char const* key, uint64_t* value)
+{
+    int ret = -1;
+    char const* x = strstr(line, key);
+
+    if (x != NULL) {
+        x += strlen(key);
+        while (*x == ' ' || *x == ':') {
+            x++;
+        }
+        if (*x >= '0' && *x <= '9') {
+            *value = strtoull(x, NULL, 10);
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
+static int perf_read_baseline(char const* file_name, perf_test_result_t* results)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_name, "r");
+
+    if (F == NULL) {
+        fprintf(stderr, "Cannot open baseline %s\n", file_name);
+        ret = -1;
+    }
+    else {
+        char line[512];
+
+        while (fgets(line, sizeof(line), F) != NULL) {
+            char const* name = strstr(line, "\"name\": \"");
+            char test_name[128];
+            size_t name_length = 0;
+            int test_number;
+
+            if (name == NULL) {
+                continue;
+            }
+            name += strlen("\"name\": \"");
+            while (name[name_length] != 0 && name[name_length] != '"' && name_length + 1 < sizeof(test_name)) {
+                test_name[name_length] = name[name_length];
+                name_length++;
+            }
+            test_name[name_length] = 0;
+
+            if ((test_number = get_test_number(test_name)) >= 0 &&
+                perf_json_get_number(line, "\"wall_us\"", &results[test_number].baseline_wall_us) == 0 &&
+                perf_json_get_number(line, "\"cpu_us\"", &results[test_number].baseline_cpu_us) == 0) {
+                results[test_number].has_baseline = 1;
+            }
+        }
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+static int perf_is_regression(uint64_t value, uint64_t baseline, int threshold, uint64_t min_time)
+{
+    return (baseline >= min_time && value * 100 > baseline * (100 + (uint64_t)threshold));
+}
+
+static int perf_compare_baseline(perf_test_result_t* results, int threshold, uint64_t min_time)
+{
+    int nb_regressions = 0;
+
+    for (size_t i = 0; i < nb_tests; i++) {
+        if (results[i].status == test_success && results[i].has_baseline) {
+            int is_cpu_regression = perf_is_regression(results[i].cpu_us, results[i].baseline_cpu_us, threshold, min_time);
+            int is_wall_regression = perf_is_regression(results[i].wall_us, results[i].baseline_wall_us, threshold, min_time);
+
+            if (is_cpu_regression || is_wall_regression) {
+                fprintf(stdout, "Test %s regresses: cpu %" PRIu64 " us vs %" PRIu64 ", wall %" PRIu64 " us vs %" PRIu64 ".\n",
+                    test_table[i].test_name, results[i].cpu_us, results[i].baseline_cpu_us,
+                    results[i].wall_us, results[i].baseline_wall_us);
+                nb_regressions++;
+            }
+        }
+    }
+
+    return nb_regressions;
+}
+
+static int usage(char const* argv0)
+{
+    fprintf(stderr, "PicoQUIC performance and stress tests\n");
+    fprintf(stderr, "Usage: %s [options] [test1 [test2 ..[testN]]]\n\n", argv0);
+    fprintf(stderr, "Valid test names are: \n");
+    for (size_t x = 0; x < nb_tests; x++) {
+        fprintf(stderr, "    ");
+
+        for (int j = 0; j < 4 && x < nb_tests; j++, x++) {
+            fprintf(stderr, "%s, ", test_table[x].test_name);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "Options: \n");
+    fprintf(stderr, "  -x test           Do not run the specified test.\n");
+    fprintf(stderr, "  -d seconds        Duration of the stress and fuzz tests, default 60.\n");
+    fprintf(stderr, "  -k runs           Run each test that many times, and keep the best times.\n");
+    fprintf(stderr, "  -w file.json      Write the results to the file.\n");
+    fprintf(stderr, "  -b file.json      Compare the results to the baseline in the file.\n");
+    fprintf(stderr, "  -t percent        Regression threshold, default %d%%.\n", PERF_TEST_DEFAULT_THRESHOLD);
+    fprintf(stderr, "  -m microseconds   Do not compare tests shorter than that in the baseline,\n");
+    fprintf(stderr, "                    default %d.\n", PERF_TEST_DEFAULT_MIN_TIME);
+    fprintf(stderr, "  -n                Disable debug prints.\n");
+    fprintf(stderr, "  -h                Print this help message\n");
+    fprintf(stderr, "  -S solution_dir   Set the path to the source files to find the default files\n");
+
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
+    int opt;
+    int nb_test_tried = 0;
+    int nb_test_failed = 0;
+    int nb_runs = 1;
+    int threshold = PERF_TEST_DEFAULT_THRESHOLD;
+    uint64_t min_time = PERF_TEST_DEFAULT_MIN_TIME;
+    int disable_debug = 0;
+    char const* result_file = NULL;
+    char const* baseline_file = NULL;
+    perf_test_result_t* results = (perf_test_result_t*)calloc(nb_tests, sizeof(perf_test_result_t));
+
+    if (results == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        ret = -1;
+    }
+
+    while (ret == 0 && (opt = getopt(argc, argv, "x:d:k:w:b:t:m:nhS:")) != -1) {
+        switch (opt) {
+        case 'x': {
+            int test_number = get_test_number(optarg);
+
+            if (test_number < 0) {
+                fprintf(stderr, "Incorrect test name: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            else {
+                results[test_number].status = test_excluded;
+            }
+            break;
+        }
+        case 'd': {
+            int duration = atoi(optarg);
+            if (duration <= 0) {
+                fprintf(stderr, "Incorrect stress duration: %s\n", optarg);
+                ret = usage(argv[0]);
+            }
+            else {
+                picoquic_stress_test_duration = ((uint64_t)duration) * 1000000ull;
+            }
+            break;
+        }
+        case 'k':
+            nb_runs = atoi(optarg);
+            if (nb_runs <= 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'w':
+            result_file = optarg;
+            break;
+        case 'b':
+            baseline_file = optarg;
+            break;
+        case 't':
+            threshold = atoi(optarg);
+            if (threshold <= 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 'm':
+            min_time = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            disable_debug = 1;
+            break;
+        case 'S':
+            picoquic_set_solution_dir(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+            break;
+        default:
+            ret = usage(argv[0]);
+            break;
+        }
+    }
+
+    if (ret == 0 && optind < argc) {
+        /* Only run the listed tests */
+        for (size_t i = 0; i < nb_tests; i++) {
+            results[i].status = test_excluded;
+        }
+        while (ret == 0 && optind < argc) {
+            int test_number = get_test_number(argv[optind]);
+
+            if (test_number < 0) {
+                fprintf(stderr, "Incorrect test name: %s\n", argv[optind]);
+                ret = usage(argv[0]);
+            }
+            else {
+                results[test_number].status = test_not_run;
+            }
+            optind++;
+        }
+    }
+
+    if (ret == 0 && baseline_file != NULL) {
+        ret = perf_read_baseline(baseline_file, results);
+    }
+
+    if (ret == 0) {
+        if (disable_debug) {
+            debug_printf_suspend();
+        }
+        else {
+            debug_printf_push_stream(stderr);
+        }
+
+        for (size_t i = 0; i < nb_tests; i++) {
+            if (results[i].status == test_not_run) {
+                nb_test_tried++;
+                if (do_one_test(i, nb_runs, &results[i], stdout) != 0) {
+                    results[i].status = test_failed;
+                    nb_test_failed++;
+                }
+                else {
+                    results[i].status = test_success;
+                }
+            }
+        }
+
+        if (result_file != NULL) {
+            ret = perf_write_json(result_file, results);
+        }
+
+        if (nb_test_failed > 0) {
+            fprintf(stdout, "Tried %d tests, %d fail.\n", nb_test_tried, nb_test_failed);
+            ret = -1;
+        }
+        else {
+            fprintf(stdout, "All %d tests pass.\n", nb_test_tried);
+        }
+
+        if (baseline_file != NULL) {
+            int nb_regressions = perf_compare_baseline(results, threshold, min_time);
+
+            if (nb_regressions > 0) {
+                fprintf(stdout, "%d tests regress by more than %d%% from the baseline.\n", nb_regressions, threshold);
+                ret = -1;
+            }
+        }
+    }
+
+    if (results != NULL) {
+        free(results);
+    }
+
+    return (ret == 0) ? 0 : 1;
+}
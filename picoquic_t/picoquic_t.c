@@ -52,9 +52,12 @@ static const picoquic_test_def_t test_table[] = {
     { "threading", util_threading_test },
     { "picohash", picohash_test },
     { "picohash_embedded", picohash_embedded_test },
+    { "picohash_open", picohash_open_test },
     { "picohash_bytes", picohash_bytes_test },
     { "siphash", siphash_test },
+    { "siphash13", siphash13_test },
     { "picolog_basic", picolog_basic_test },
+    { "picolog_index", picolog_index_test },
     { "bytestream", bytestream_test },
     { "sockloop_basic", sockloop_basic_test },
     { "sockloop_eio", sockloop_eio_test },
@@ -64,8 +67,39 @@ static const picoquic_test_def_t test_table[] = {
     { "sockloop_nat", sockloop_nat_test },
     { "sockloop_thread", sockloop_thread_test },
     { "sockloop_thread_name", sockloop_thread_name_test },
+    { "sockloop_batch", sockloop_batch_test },
+    { "sockloop_uring", sockloop_uring_test },
+    { "sockloop_select", sockloop_select_test },
+    { "sockloop_txtime", sockloop_txtime_test },
+    { "sockloop_zerocopy", sockloop_zerocopy_test },
+    { "sockloop_command", sockloop_command_test },
+    { "sockloop_rio", sockloop_rio_test },
+    { "sockloop_provider", sockloop_provider_test },
+    { "sockloop_busy_poll", sockloop_busy_poll_test },
+    { "sockloop_affinity", sockloop_affinity_test },
+    { "sockloop_timer_slack", sockloop_timer_slack_test },
+    { "sockloop_reuseport", sockloop_reuseport_test },
+    { "sockloop_dispatch", sockloop_dispatch_test },
+    { "sockloop_gro", sockloop_gro_test },
+    { "sockloop_timestamp", sockloop_timestamp_test },
+    { "sockloop_metrics", sockloop_metrics_test },
     { "splay", splay_test },
+    { "rbtree", rbtree_test },
+    { "splay_bench", splay_bench_test },
+    { "timer_wheel", timer_wheel_test },
     { "create_cnx", create_cnx_test },
+    { "object_pool", object_pool_test },
+    { "misc_frame_pool", misc_frame_pool_test },
+    { "packet_size_class", packet_size_class_test },
+    { "packet_index", packet_index_test },
+    { "ack_batch", ack_batch_test },
+    { "stateless_queue", stateless_queue_test },
+    { "prewarm_pools", prewarm_pools_test },
+    { "path_table", path_table_test },
+    { "loss_check_path", loss_check_path_test },
+    { "cnx_layout", cnx_layout_test },
+    { "clock_cache", clock_cache_test },
+    { "reset_filter", reset_filter_test },
     { "create_quic", create_quic_test },
     { "parseheader", parseheadertest },
     { "incoming_initial", incoming_initial_test },
@@ -73,6 +107,7 @@ static const picoquic_test_def_t test_table[] = {
     { "pn2pn64", pn2pn64test },
     { "intformat", intformattest },
     { "varint", varint_test },
+    { "varint_bench", varint_bench_test },
     { "sqrt_for_test", sqrt_for_test_test },
     { "ack_sack", sacktest },
     { "frames_skip", skip_frame_test },
@@ -86,24 +121,36 @@ static const picoquic_test_def_t test_table[] = {
     { "TlsStreamFrame", TlsStreamFrameTest },
     { "StreamZeroFrame", StreamZeroFrameTest },
     { "stream_splay", stream_splay_test },
+    { "stream_index", stream_index_test },
     { "stream_output", stream_output_test },
+    { "stream_scheduler", stream_scheduler_test },
+    { "stream_reassembly_ring", stream_reassembly_ring_test },
     { "stream_retransmit_copy", test_copy_for_retransmit },
     { "dataqueue_copy", dataqueue_copy_test },
     { "dataqueue_packet", dataqueue_packet_test },
+    { "dataqueue_bucket", dataqueue_bucket_test },
     { "stateless_blowback", test_stateless_blowback },
     { "ack_send", sendacktest },
     { "ack_loop", sendack_loop_test },
     { "ack_range", ackrange_test },
+    { "sack_list_array", sack_list_array_test },
     { "ack_disorder", ack_disorder_test },
     { "ack_horizon", ack_horizon_test },
+    { "ack_scan_floor", ack_scan_floor_test },
+    { "ack_range_cap", ack_range_cap_test },
     { "ack_of_ack", ack_of_ack_test },
     { "ackfrq_basic", ackfrq_basic_test },
     { "ackfrq_short", ackfrq_short_test },
+    { "ackfrq_adaptive", ackfrq_adaptive_test },
     { "sim_link", sim_link_test },
+    { "sim_link_sched", sim_link_sched_test },
     { "clear_text_aead", cleartext_aead_test },
     { "pn_ctr", pn_ctr_test },
     { "cleartext_pn_enc", cleartext_pn_enc_test },
+    { "aead_seal_batch", aead_seal_batch_test },
     { "cid_for_lb", cid_for_lb_test },
+    { "cid_for_lb_batch", cid_for_lb_batch_test },
+    { "lb_router", lb_router_test },
     { "cid_for_lb_cli", cid_for_lb_cli_test },
     { "retry_protection_vector", retry_protection_vector_test },
     { "retry_protection_v2", retry_protection_v2_test },
@@ -117,12 +164,17 @@ static const picoquic_test_def_t test_table[] = {
     { "new_cnxid", new_cnxid_test },
     { "pacing", pacing_test },
     { "pacing_repeat", pacing_repeat_test },
+    { "pacing_precision", pacing_precision_test },
 #if 0
     /* The TLS API connect test is only useful when debugging issues step by step */
     { "tls_api_connect", tls_api_connect_test },
 #endif
     { "tls_api", tls_api_test },
     { "tls_api_inject_hs_ack", tls_api_inject_hs_ack_test },
+    { "async_sign", async_sign_test },
+    { "key_share_pool", key_share_pool_test },
+    { "initial_key_cache", initial_key_cache_test },
+    { "cert_compress", cert_compress_test },
     { "null_sni", null_sni_test },
     { "silence_test", tls_api_silence_test },
     { "code_version", code_version_test },
@@ -146,6 +198,7 @@ static const picoquic_test_def_t test_table[] = {
     { "datagram_small", datagram_small_test },
     { "datagram_small_new", datagram_small_new_test },
     { "datagram_small_packet", datagram_small_packet_test },
+    { "datagram_ring", datagram_ring_test },
     { "datagram_wifi", datagram_wifi_test },
     { "ddos_amplification", ddos_amplification_test },
     { "ddos_amplification_0rtt", ddos_amplification_0rtt_test },
@@ -168,6 +221,19 @@ static const picoquic_test_def_t test_table[] = {
     { "implicit_ack", implicit_ack_test },
     { "stateless_reset", stateless_reset_test },
     { "stateless_reset_bad", stateless_reset_bad_test },
+    { "zero_copy_stream", zero_copy_stream_test },
+    { "stream_iov", stream_iov_test },
+    { "stream_cork", stream_cork_test },
+    { "stream_repeat_queue", stream_repeat_queue_test },
+    { "stream_repeat_strip", stream_repeat_strip_test },
+    { "cnx_handoff", cnx_handoff_test },
+    { "delivery_batch", delivery_batch_test },
+    { "send_backlog", send_backlog_test },
+    { "timer_slack", timer_slack_test },
+    { "stream_deadline", stream_deadline_test },
+    { "fec_repair", fec_repair_test },
+    { "preemptive_budget", preemptive_budget_test },
+    { "reorder_window", reorder_window_test },
     { "stateless_reset_client", stateless_reset_client_test },
     { "stateless_reset_handshake", stateless_reset_handshake_test },
     { "immediate_close", immediate_close_test },
@@ -175,11 +241,20 @@ static const picoquic_test_def_t test_table[] = {
     { "tls_api_very_long_max", tls_api_very_long_max_test },
     { "tls_api_very_long_with_err", tls_api_very_long_with_err_test },
     { "tls_api_very_long_congestion", tls_api_very_long_congestion_test },
+    { "cnx_memory_budget", cnx_memory_budget_test },
+    { "rcv_window_autotune", rcv_window_autotune_test },
+    { "max_streams_autotune", max_streams_autotune_test },
+    { "in_place_decryption", in_place_decryption_test },
+    { "cnx_hibernation", cnx_hibernation_test },
+    { "prepare_next_packets", prepare_next_packets_test },
     { "many_short_loss", many_short_loss_test },
     { "retry", tls_api_retry_test },
     { "retry_large", tls_api_retry_large_test},
+    { "admission_control", admission_control_test },
+    { "compact_closing", compact_closing_test },
     { "retry_token", tls_retry_token_test },
     { "retry_token_valid", tls_retry_token_valid_test },
+    { "quic_group", quic_group_test },
     { "two_connections", tls_api_two_connections_test },
     { "multiple_versions", tls_api_multiple_versions_test },
     { "keep_alive", keep_alive_test },
@@ -195,6 +270,10 @@ static const picoquic_test_def_t test_table[] = {
     { "ticket_seed_from_bdp_frame", ticket_seed_from_bdp_frame_test },
     { "token_store", token_store_test },
     { "token_reuse_api", token_reuse_api_test },
+    { "token_registry_flood", token_registry_flood_test },
+    { "initial_rate_limit", initial_rate_limit_test },
+    { "ticket_store_index", ticket_store_index_test },
+    { "shared_ticket_store", shared_ticket_store_test },
     { "session_resume", session_resume_test },
     { "zero_rtt", zero_rtt_test },
     { "zero_rtt_loss", zero_rtt_loss_test },
@@ -207,6 +286,8 @@ static const picoquic_test_def_t test_table[] = {
     { "mtu_delayed", mtu_delayed_test },
     { "mtu_required", mtu_required_test },
     { "mtu_max", mtu_max_test },
+    { "mtu_jumbo", mtu_jumbo_test },
+    { "pmtu_cache", pmtu_cache_test },
     { "mtu_drop_bbr", mtu_drop_bbr_test },
     { "mtu_drop_cubic", mtu_drop_cubic_test },
     { "mtu_drop_dcubic", mtu_drop_dcubic_test },
@@ -229,8 +310,10 @@ static const picoquic_test_def_t test_table[] = {
     { "spurious_retransmit", spurious_retransmit_test },
     { "tls_zero_share", tls_zero_share_test },
     { "transport_param_log", transport_param_log_test },
+    { "transport_param_cache", transport_param_cache_test },
     { "bad_certificate", bad_certificate_test },
     { "set_verify_certificate_callback_test", set_verify_certificate_callback_test },
+    { "cert_verify_cache", cert_verify_cache_test },
     { "virtual_time" , virtual_time_test },
     { "different_params", tls_different_params_test },
     { "quant_params", tls_quant_params_test },
@@ -242,9 +325,11 @@ static const picoquic_test_def_t test_table[] = {
     { "nat_rebinding_zero", nat_rebinding_zero_test },
     { "nat_rebinding_latency", nat_rebinding_latency_test },
     { "nat_rebinding_fast", fast_nat_rebinding_test},
+    { "port_rebinding_fast", port_rebinding_fast_test },
     { "spinbit", spinbit_test },
     { "spinbit_bad", spinbit_bad_test },
     { "spinbit_null", spinbit_null_test },
+    { "spinbit_observer", spinbit_observer_test },
     { "spinbit_randclient", spinbit_randclient_test },
     { "spinbit_random", spinbit_random_test },
     { "loss_bit", loss_bit_test},
@@ -258,9 +343,12 @@ static const picoquic_test_def_t test_table[] = {
     { "zero_rtt_many_losses", zero_rtt_many_losses_test },
     { "zero_rtt_long", zero_rtt_long_test },
     { "zero_rtt_delay", zero_rtt_delay_test },
+    { "zero_rtt_replay", zero_rtt_replay_test },
+    { "ticket_key_rotation", ticket_key_rotation_test },
     { "random_tester", random_tester_test},
     { "random_gauss", random_gauss_test},
     { "random_public_tester", random_public_tester_test},
+    { "random_buffered", random_buffered_test },
     { "cnxid_transmit", transmit_cnxid_test },
     { "cnxid_transmit_disable", transmit_cnxid_disable_test },
     { "cnxid_transmit_r_before", transmit_cnxid_retire_before_test },
@@ -268,6 +356,7 @@ static const picoquic_test_def_t test_table[] = {
     { "cnxid_transmit_r_early", transmit_cnxid_retire_early_test },
     { "probe_api", probe_api_test },
     { "memlog", memlog_test },
+    { "memlog_ring", memlog_ring_test },
     { "migration" , migration_test },
     { "migration_long", migration_test_long },
     { "migration_with_loss", migration_test_loss },
@@ -286,6 +375,7 @@ static const picoquic_test_def_t test_table[] = {
     { "key_rotation", key_rotation_test },
     { "key_rotation_server", key_rotation_auto_server },
     { "key_rotation_client", key_rotation_auto_client },
+    { "key_rotation_precompute", key_rotation_precompute_test },
     { "false_migration", false_migration_test },
     { "nat_handshake", nat_handshake_test },
     { "key_rotation_vector", key_rotation_vector_test },
@@ -303,7 +393,15 @@ static const picoquic_test_def_t test_table[] = {
     { "qlog_trace_auto", qlog_trace_auto_test },
     { "qlog_trace_only", qlog_trace_only_test },
     { "qlog_trace_ecn", qlog_trace_ecn_test },
+    { "qlog_trace_async", qlog_trace_async_test },
+    { "qlog_trace_auto_async", qlog_trace_auto_async_test },
+    { "qlog_trace_compressed", qlog_trace_compressed_test },
+    { "qlog_trace_compressed_async", qlog_trace_compressed_async_test },
+    { "qlog_trace_seq", qlog_trace_seq_test },
+    { "qlog_trace_seq_async", qlog_trace_seq_async_test },
+    { "log_policy", log_policy_test },
     { "perflog", perflog_test },
+    { "cpu_accounting", cpu_accounting_test },
     { "nat_rebinding_stress", rebinding_stress_test },
     { "random_padding", random_padding_test },
     { "ec00_zero", ec00_zero_test },
@@ -314,6 +412,7 @@ static const picoquic_test_def_t test_table[] = {
     { "ec5c_silly_cid", ec5c_silly_cid_test },
     { "ec9a_preemptive_amok", ec9a_preemptive_amok_test },
     { "error_reason", error_reason_test },
+    { "textlog_rate_limit", textlog_rate_limit_test },
     { "idle_server", idle_server_test },
     { "idle_timeout", idle_timeout_test },
     { "reset_ack_max", reset_ack_max_test },
@@ -383,6 +482,13 @@ static const picoquic_test_def_t test_table[] = {
     { "bdp_cubic", bdp_cubic_test },
 #endif
     { "bdp_bbr1", bdp_bbr1_test },
+    { "careful_resume", careful_resume_test },
+    { "cc_snapshot", cc_snapshot_test },
+    { "cc_fixed_point", cc_fixed_point_test },
+    { "cc_hystart_pp", cc_hystart_pp_test },
+    { "cc_telemetry", cc_telemetry_test },
+    { "cnx_stats", cnx_stats_test },
+    { "cc_replay", cc_replay_test },
     { "bdp_short", bdp_short_test },
     { "bdp_short_hi", bdp_short_hi_test },
     { "bdp_short_lo", bdp_short_lo_test },
@@ -398,9 +504,11 @@ static const picoquic_test_def_t test_table[] = {
     { "limited_bbr", limited_bbr_test },
     { "limited_batch", limited_batch_test },
     { "limited_safe", limited_safe_test },
+    { "limited_recv_batch", limited_recv_batch_test },
     { "send_stream_blocked", send_stream_blocked_test },
     { "stream_ack", stream_ack_test },
     { "queue_network_input", queue_network_input_test },
+    { "queue_network_view", queue_network_view_test },
     { "pacing_update", pacing_update_test },
     { "quality_update", quality_update_test },
     { "direct_receive", direct_receive_test },
@@ -414,6 +522,10 @@ static const picoquic_test_def_t test_table[] = {
     { "initial_race", initial_race_test },
     { "chacha20", chacha20_test },
     { "cnx_limit", cnx_limit_test },
+    { "cnx_wheel", cnx_wheel_test },
+    { "race_cnx", race_cnx_test },
+    { "egress_scheduler", egress_scheduler_test },
+    { "congestion_manager", congestion_manager_test },
     { "cert_verify_bad_cert", cert_verify_bad_cert_test },
     { "cert_verify_bad_sni", cert_verify_bad_sni_test },
     { "cert_verify_null", cert_verify_null_test },
@@ -494,6 +606,12 @@ static const picoquic_test_def_t test_table[] = {
     { "multipath_backup", multipath_backup_test },
     { "multipath_standup", multipath_standup_test },
     { "multipath_discovery", multipath_discovery_test },
+    { "multipath_sched_rtt", multipath_sched_rtt_test },
+    { "multipath_sched_capacity", multipath_sched_capacity_test },
+    { "multipath_sched_redundant", multipath_sched_redundant_test },
+    { "multipath_lia", multipath_lia_test },
+    { "multipath_olia", multipath_olia_test },
+    { "multipath_balia", multipath_balia_test },
     { "multipath_qlog", multipath_qlog_test },
     { "multipath_tunnel", multipath_tunnel_test },
     { "monopath_0rtt", monopath_0rtt_test },
@@ -504,12 +622,14 @@ static const picoquic_test_def_t test_table[] = {
     { "ech_config_p", ech_config_p_test },
     { "ech_e2e", ech_e2e_test },
     { "ech_grease", ech_grease_test },
+    { "ech_config_cache", ech_config_cache_test },
     { "getter", getter_test },
     { "grease_quic_bit", grease_quic_bit_test },
     { "grease_quic_bit_one_way", grease_quic_bit_one_way_test },
     { "pn_random", pn_random_test },
     { "port_blocked", port_blocked_test },
     { "cplusplus", cplusplustest },
+    { "cplusplus_wrapper", cplusplus_wrapper_test },
     { "stress", stress_test },
     { "fuzz", fuzz_test },
     { "fuzz_initial", fuzz_initial_test},
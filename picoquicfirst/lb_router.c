@@ -0,0 +1,643 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* QUIC-LB router mode of picoquicdemo.
+*
+* The router listens on the server port, and forwards the incoming datagrams
+* to the backends selected by picoquic_lb_router_route_batch, i.e., by the
+* server ID decoded from the destination CID, or by consistent hashing for
+* the client Initial packets. The LB configuration is the same "-i" string
+* used by the servers, so the router decodes exactly the CIDs that the
+* servers generate; the router ignores the server ID field of that string.
+*
+* The routing decision is stateless, but the backends reply to the address
+* from which they receive packets. The router thus opens one upstream socket
+* per client address, as a NAT would, and relays the replies received on that
+* socket to the client. Upstream sockets are closed after an idle period.
+* If a client migrates, it gets a new upstream socket, but its packets still
+* reach the same backend thanks to the CID.
+*
+* On Linux, datagrams are received and sent in batches with recvmmsg and
+* sendmmsg. Other Unix systems use one system call per datagram. The router
+* mode is not available on Windows.
+*/
+
+#ifndef _WINDOWS
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Required for recvmmsg and sendmmsg */
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "picosocks.h"
+#include "picohash.h"
+#include "tls_api.h"
+#include "picoquic_config.h"
+#include "picoquic_lb.h"
+#include "picoquic_lb_router.h"
+#include "lb_router.h"
+
+#define LB_ROUTER_BATCH 32
+#define LB_ROUTER_FLOW_IDLE 60000000ull
+#define LB_ROUTER_MAX_BACKENDS 256
+#define LB_ROUTER_POLL_MAX 100
+
+typedef struct st_lb_router_flow_t {
+    picohash_item hash_item;
+    struct sockaddr_storage client_addr;
+    SOCKET_TYPE fd;
+    uint64_t last_time;
+} lb_router_flow_t;
+
+typedef struct st_lb_router_batch_t {
+    int nb;
+    uint8_t buffer[LB_ROUTER_BATCH][PICOQUIC_MAX_PACKET_SIZE];
+    size_t length[LB_ROUTER_BATCH];
+    struct sockaddr_storage addr[LB_ROUTER_BATCH];
+} lb_router_batch_t;
+
+typedef struct st_lb_router_ctx_t {
+    picoquic_lb_router_t router;
+    struct sockaddr_storage backend_addr[LB_ROUTER_MAX_BACKENDS];
+    SOCKET_TYPE probe_fd[LB_ROUTER_MAX_BACKENDS];
+    SOCKET_TYPE listen_fd;
+    picohash_table* flow_table;
+    lb_router_flow_t** flows;
+    size_t nb_flows;
+    size_t max_flows;
+    uint64_t nb_flows_refused;
+    uint8_t hash_seed[16];
+    struct pollfd* poll_fds;
+    lb_router_batch_t* batch;
+} lb_router_ctx_t;
+
+static uint64_t lb_router_flow_hash(const void* key, const uint8_t* hash_seed)
+{
+    const lb_router_flow_t* flow = (const lb_router_flow_t*)key;
+
+    return picoquic_hash_addr((const struct sockaddr*)&flow->client_addr, hash_seed);
+}
+
+static int lb_router_flow_compare(const void* key1, const void* key2)
+{
+    const lb_router_flow_t* flow1 = (const lb_router_flow_t*)key1;
+    const lb_router_flow_t* flow2 = (const lb_router_flow_t*)key2;
+
+    return picoquic_compare_addr((const struct sockaddr*)&flow1->client_addr, (const struct sockaddr*)&flow2->client_addr);
+}
+
+static picohash_item* lb_router_flow_to_item(const void* key)
+{
+    lb_router_flow_t* flow = (lb_router_flow_t*)key;
+
+    return &flow->hash_item;
+}
+
+/* All the router sockets are dual stack, so they can reach IPv4 and
+ * IPv6 peers. IPv4 addresses are used in their mapped form. */
+static SOCKET_TYPE lb_router_open_socket(void)
+{
+    SOCKET_TYPE fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (fd != INVALID_SOCKET) {
+        int v6_only = 0;
+        (void)setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+    }
+
+    return fd;
+}
+
+/* Receive up to LB_ROUTER_BATCH datagrams without blocking. */
+static int lb_router_recv_batch(SOCKET_TYPE fd, lb_router_batch_t* batch)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[LB_ROUTER_BATCH];
+    struct iovec iovs[LB_ROUTER_BATCH];
+    int nb_msg;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < LB_ROUTER_BATCH; i++) {
+        iovs[i].iov_base = batch->buffer[i];
+        iovs[i].iov_len = PICOQUIC_MAX_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &batch->addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    nb_msg = recvmmsg(fd, msgs, LB_ROUTER_BATCH, MSG_DONTWAIT, NULL);
+    batch->nb = (nb_msg < 0) ? 0 : nb_msg;
+    for (int i = 0; i < batch->nb; i++) {
+        batch->length[i] = msgs[i].msg_len;
+    }
+#else
+    batch->nb = 0;
+    while (batch->nb < LB_ROUTER_BATCH) {
+        socklen_t addr_length = sizeof(struct sockaddr_storage);
+        ssize_t bytes_recv = recvfrom(fd, batch->buffer[batch->nb], PICOQUIC_MAX_PACKET_SIZE, MSG_DONTWAIT,
+            (struct sockaddr*)&batch->addr[batch->nb], &addr_length);
+        if (bytes_recv <= 0) {
+            break;
+        }
+        batch->length[batch->nb] = (size_t)bytes_recv;
+        batch->nb++;
+    }
+#endif
+    return batch->nb;
+}
+
+/* Send datagrams in as few system calls as possible. Errors are ignored,
+ * as they would be by a router: QUIC will retransmit. */
+static void lb_router_send_batch(SOCKET_TYPE fd, uint8_t* const* buffer, const size_t* length,
+    struct sockaddr_storage* const* addr, int nb)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[LB_ROUTER_BATCH];
+    struct iovec iovs[LB_ROUTER_BATCH];
+    int nb_done = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < nb; i++) {
+        iovs[i].iov_base = buffer[i];
+        iovs[i].iov_len = length[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = addr[i];
+        msgs[i].msg_hdr.msg_namelen = picoquic_addr_length((struct sockaddr*)addr[i]);
+    }
+    while (nb_done < nb) {
+        int nb_sent = sendmmsg(fd, msgs + nb_done, nb - nb_done, 0);
+        if (nb_sent <= 0) {
+            /* Skip the message that failed */
+            nb_sent = 1;
+        }
+        nb_done += nb_sent;
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        (void)sendto(fd, buffer[i], length[i], 0, (struct sockaddr*)addr[i],
+            picoquic_addr_length((struct sockaddr*)addr[i]));
+    }
+#endif
+}
+
+static void lb_router_flow_delete(lb_router_ctx_t* ctx, size_t flow_index)
+{
+    lb_router_flow_t* flow = ctx->flows[flow_index];
+
+    picohash_delete_key(ctx->flow_table, flow, 0);
+    SOCKET_CLOSE(flow->fd);
+    free(flow);
+    ctx->nb_flows--;
+    ctx->flows[flow_index] = ctx->flows[ctx->nb_flows];
+    ctx->flows[ctx->nb_flows] = NULL;
+}
+
+static lb_router_flow_t* lb_router_flow_get(lb_router_ctx_t* ctx, struct sockaddr_storage* client_addr, uint64_t current_time)
+{
+    lb_router_flow_t key;
+    lb_router_flow_t* flow = NULL;
+    picohash_item* item;
+
+    memset(&key, 0, sizeof(key));
+    picoquic_store_addr(&key.client_addr, (struct sockaddr*)client_addr);
+    item = picohash_retrieve(ctx->flow_table, &key);
+    if (item != NULL) {
+        flow = (lb_router_flow_t*)item->key;
+    }
+    else if (ctx->nb_flows >= ctx->max_flows) {
+        ctx->nb_flows_refused++;
+    }
+    else {
+        flow = (lb_router_flow_t*)malloc(sizeof(lb_router_flow_t));
+        if (flow != NULL) {
+            memset(flow, 0, sizeof(lb_router_flow_t));
+            picoquic_store_addr(&flow->client_addr, (struct sockaddr*)client_addr);
+            flow->fd = lb_router_open_socket();
+            if (flow->fd == INVALID_SOCKET || picohash_insert(ctx->flow_table, flow) != 0) {
+                if (flow->fd != INVALID_SOCKET) {
+                    SOCKET_CLOSE(flow->fd);
+                }
+                free(flow);
+                flow = NULL;
+                ctx->nb_flows_refused++;
+            }
+            else {
+                ctx->flows[ctx->nb_flows++] = flow;
+            }
+        }
+    }
+    if (flow != NULL) {
+        flow->last_time = current_time;
+    }
+
+    return flow;
+}
+
+/* Datagrams from clients: route the whole batch, then send the runs of
+ * datagrams that share the same upstream socket together. */
+static void lb_router_forward_to_backends(lb_router_ctx_t* ctx, uint64_t current_time)
+{
+    lb_router_batch_t* batch = ctx->batch;
+    const uint8_t* packet[LB_ROUTER_BATCH];
+    int backend_index[LB_ROUTER_BATCH];
+    lb_router_flow_t* flow[LB_ROUTER_BATCH];
+    uint8_t* out_buffer[LB_ROUTER_BATCH];
+    size_t out_length[LB_ROUTER_BATCH];
+    struct sockaddr_storage* out_addr[LB_ROUTER_BATCH];
+
+    while (lb_router_recv_batch(ctx->listen_fd, batch) > 0) {
+        int nb_out = 0;
+
+        for (int i = 0; i < batch->nb; i++) {
+            packet[i] = batch->buffer[i];
+        }
+        picoquic_lb_router_route_batch(&ctx->router, packet, batch->length, (size_t)batch->nb, backend_index);
+
+        for (int i = 0; i < batch->nb; i++) {
+            flow[i] = (backend_index[i] < 0) ? NULL : lb_router_flow_get(ctx, &batch->addr[i], current_time);
+        }
+        for (int i = 0; i < batch->nb; i++) {
+            if (flow[i] != NULL) {
+                out_buffer[nb_out] = batch->buffer[i];
+                out_length[nb_out] = batch->length[i];
+                out_addr[nb_out] = &ctx->backend_addr[backend_index[i]];
+                nb_out++;
+                if (i + 1 >= batch->nb || flow[i + 1] != flow[i]) {
+                    lb_router_send_batch(flow[i]->fd, out_buffer, out_length, out_addr, nb_out);
+                    nb_out = 0;
+                }
+            }
+        }
+    }
+}
+
+/* Datagrams from the backends: relay them to the client of the flow */
+static void lb_router_forward_to_client(lb_router_ctx_t* ctx, lb_router_flow_t* flow, uint64_t current_time)
+{
+    lb_router_batch_t* batch = ctx->batch;
+    uint8_t* out_buffer[LB_ROUTER_BATCH];
+    struct sockaddr_storage* out_addr[LB_ROUTER_BATCH];
+
+    while (lb_router_recv_batch(flow->fd, batch) > 0) {
+        for (int i = 0; i < batch->nb; i++) {
+            out_buffer[i] = batch->buffer[i];
+            out_addr[i] = &flow->client_addr;
+        }
+        lb_router_send_batch(ctx->listen_fd, out_buffer, batch->length, out_addr, batch->nb);
+        flow->last_time = current_time;
+    }
+}
+
+static void lb_router_health_checks(lb_router_ctx_t* ctx, uint64_t current_time)
+{
+    for (size_t i = 0; i < ctx->router.nb_backends; i++) {
+        if (current_time >= ctx->router.backends[i].next_probe_time) {
+            uint8_t probe[PICOQUIC_LB_ROUTER_PROBE_SIZE];
+            size_t length = picoquic_lb_router_format_probe(&ctx->router, (int)i, probe, sizeof(probe), current_time);
+            if (length > 0) {
+                (void)sendto(ctx->probe_fd[i], probe, length, 0, (struct sockaddr*)&ctx->backend_addr[i],
+                    picoquic_addr_length((struct sockaddr*)&ctx->backend_addr[i]));
+            }
+        }
+    }
+    for (size_t i = 0; i < ctx->router.nb_backends; i++) {
+        if (ctx->router.backends[i].is_healthy &&
+            ctx->router.backends[i].last_response_time + ctx->router.health_timeout < current_time) {
+            fprintf(stdout, "Backend %zu (server ID 0x%" PRIx64 ") is down.\n", i, ctx->router.backends[i].server_id);
+        }
+    }
+    picoquic_lb_router_update_health(&ctx->router, current_time);
+    /* Close the idle flows */
+    for (size_t i = 0; i < ctx->nb_flows;) {
+        if (ctx->flows[i]->last_time + LB_ROUTER_FLOW_IDLE < current_time) {
+            lb_router_flow_delete(ctx, i);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+/* Parse the backend list, "sid/address/port[,sid/address/port]*", with the
+ * server IDs in hexadecimal as in the LB configuration string. */
+static int lb_router_parse_backends(lb_router_ctx_t* ctx, char const* backend_list, uint64_t current_time)
+{
+    int ret = 0;
+    char const* x = backend_list;
+
+    while (ret == 0 && *x != 0) {
+        char addr_text[128];
+        size_t addr_length = 0;
+        uint64_t server_id = 0;
+        int nb_digits = 0;
+        int port = 0;
+        int is_name = 0;
+        int backend_index;
+
+        while (*x != 0 && *x != '/') {
+            int c = *x++;
+            if (c >= '0' && c <= '9') {
+                c -= '0';
+            }
+            else if (c >= 'a' && c <= 'f') {
+                c -= 'a' - 10;
+            }
+            else if (c >= 'A' && c <= 'F') {
+                c -= 'A' - 10;
+            }
+            else {
+                ret = -1;
+                break;
+            }
+            server_id = (server_id << 4) | (uint64_t)c;
+            nb_digits++;
+        }
+        if (ret == 0 && (*x != '/' || nb_digits == 0 || nb_digits > 16)) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            x++;
+            while (*x != 0 && *x != '/' && addr_length + 1 < sizeof(addr_text)) {
+                addr_text[addr_length++] = *x++;
+            }
+            addr_text[addr_length] = 0;
+            if (*x != '/' || addr_length == 0) {
+                ret = -1;
+            }
+            else {
+                x++;
+                while (*x >= '0' && *x <= '9') {
+                    port = 10 * port + (*x++ - '0');
+                }
+                if (port <= 0 || port > 0xffff || (*x != 0 && *x != ',')) {
+                    ret = -1;
+                }
+                else if (*x == ',') {
+                    x++;
+                }
+            }
+        }
+        if (ret == 0) {
+            backend_index = picoquic_lb_router_add_backend(&ctx->router, server_id, current_time);
+            if (backend_index < 0 ||
+                picoquic_get_server_address(addr_text, port, &ctx->backend_addr[backend_index], &is_name) != 0) {
+                ret = -1;
+            }
+            else {
+                if (ctx->backend_addr[backend_index].ss_family == AF_INET) {
+                    struct sockaddr_in v4 = *(struct sockaddr_in*)&ctx->backend_addr[backend_index];
+                    struct sockaddr_in6* v6 = (struct sockaddr_in6*)&ctx->backend_addr[backend_index];
+                    memset(v6, 0, sizeof(struct sockaddr_in6));
+                    v6->sin6_family = AF_INET6;
+                    v6->sin6_port = v4.sin_port;
+                    v6->sin6_addr.s6_addr[10] = 0xff;
+                    v6->sin6_addr.s6_addr[11] = 0xff;
+                    memcpy(&v6->sin6_addr.s6_addr[12], &v4.sin_addr, 4);
+                }
+                ctx->probe_fd[backend_index] = lb_router_open_socket();
+                if (ctx->probe_fd[backend_index] == INVALID_SOCKET) {
+                    ret = -1;
+                }
+            }
+        }
+        if (ret != 0) {
+            fprintf(stderr, "Invalid backend specification: %s\n", backend_list);
+        }
+    }
+
+    if (ret == 0 && ctx->router.nb_backends == 0) {
+        fprintf(stderr, "No backend specified.\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static void lb_router_ctx_release(lb_router_ctx_t* ctx)
+{
+    while (ctx->nb_flows > 0) {
+        lb_router_flow_delete(ctx, ctx->nb_flows - 1);
+    }
+    for (size_t i = 0; i < ctx->router.nb_backends; i++) {
+        if (ctx->probe_fd[i] != INVALID_SOCKET) {
+            SOCKET_CLOSE(ctx->probe_fd[i]);
+        }
+    }
+    if (ctx->listen_fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(ctx->listen_fd);
+    }
+    if (ctx->flow_table != NULL) {
+        picohash_delete(ctx->flow_table, 0);
+    }
+    if (ctx->flows != NULL) {
+        free(ctx->flows);
+    }
+    if (ctx->poll_fds != NULL) {
+        free(ctx->poll_fds);
+    }
+    if (ctx->batch != NULL) {
+        free(ctx->batch);
+    }
+    if (ctx->router.decoder.ecb_encrypt_ctx != NULL) {
+        picoquic_aes128_ecb_free(ctx->router.decoder.ecb_encrypt_ctx);
+    }
+    if (ctx->router.decoder.ecb_decrypt_ctx != NULL) {
+        picoquic_aes128_ecb_free(ctx->router.decoder.ecb_decrypt_ctx);
+    }
+    picoquic_lb_router_clear(&ctx->router);
+}
+
+static int lb_router_ctx_init(lb_router_ctx_t* ctx, picoquic_quic_config_t* config, char const* backend_list, uint64_t current_time)
+{
+    int ret = 0;
+    picoquic_load_balancer_config_t lb_config;
+    picoquic_lb_decoder_t decoder;
+    void* ecb_enc = NULL;
+    void* ecb_dec = NULL;
+
+    memset(ctx, 0, sizeof(lb_router_ctx_t));
+    ctx->listen_fd = INVALID_SOCKET;
+    for (int i = 0; i < LB_ROUTER_MAX_BACKENDS; i++) {
+        ctx->probe_fd[i] = INVALID_SOCKET;
+    }
+
+    if (config->cnx_id_cbdata == NULL ||
+        picoquic_lb_compat_cid_config_parse(&lb_config, config->cnx_id_cbdata, strlen(config->cnx_id_cbdata)) != 0) {
+        fprintf(stderr, "The router mode requires a valid LB configuration (-i).\n");
+        ret = -1;
+    }
+    else {
+        if (lb_config.method != picoquic_load_balancer_cid_clear) {
+            ecb_enc = picoquic_aes128_ecb_create(1, lb_config.cid_encryption_key);
+            ecb_dec = picoquic_aes128_ecb_create(0, lb_config.cid_encryption_key);
+        }
+        if (picoquic_lb_decoder_init(&decoder, lb_config.method, lb_config.first_byte_encodes_length,
+            lb_config.server_id_length, lb_config.nonce_length, lb_config.connection_id_length,
+            picoquic_aes128_ecb_encrypt, ecb_enc, ecb_dec) != 0) {
+            fprintf(stderr, "Cannot create the CID decoder for: %s\n", config->cnx_id_cbdata);
+            ret = -1;
+        }
+        else {
+            picoquic_public_random(ctx->hash_seed, sizeof(ctx->hash_seed));
+            ret = picoquic_lb_router_init(&ctx->router, &decoder, LB_ROUTER_MAX_BACKENDS, picoquic_public_random_64());
+        }
+        if (ret != 0) {
+            if (ecb_enc != NULL) {
+                picoquic_aes128_ecb_free(ecb_enc);
+            }
+            if (ecb_dec != NULL) {
+                picoquic_aes128_ecb_free(ecb_dec);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        ret = lb_router_parse_backends(ctx, backend_list, current_time);
+    }
+
+    if (ret == 0) {
+        ctx->max_flows = (config->nb_connections > 0) ? config->nb_connections : 256;
+        ctx->flows = (lb_router_flow_t**)malloc(ctx->max_flows * sizeof(lb_router_flow_t*));
+        ctx->poll_fds = (struct pollfd*)malloc((1 + LB_ROUTER_MAX_BACKENDS + ctx->max_flows) * sizeof(struct pollfd));
+        ctx->batch = (lb_router_batch_t*)malloc(sizeof(lb_router_batch_t));
+        ctx->flow_table = picohash_create_ex(ctx->max_flows, lb_router_flow_hash, lb_router_flow_compare,
+            lb_router_flow_to_item, ctx->hash_seed);
+        if (ctx->flows == NULL || ctx->poll_fds == NULL || ctx->batch == NULL || ctx->flow_table == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ctx->listen_fd = lb_router_open_socket();
+        if (ctx->listen_fd == INVALID_SOCKET ||
+            picoquic_bind_to_port(ctx->listen_fd, AF_INET6, config->server_port) != 0) {
+            fprintf(stderr, "Cannot open the router socket on port %d\n", config->server_port);
+            ret = -1;
+        }
+        else if (config->socket_buffer_size > 0) {
+            int so_buf = config->socket_buffer_size;
+            (void)setsockopt(ctx->listen_fd, SOL_SOCKET, SO_RCVBUF, &so_buf, sizeof(so_buf));
+            (void)setsockopt(ctx->listen_fd, SOL_SOCKET, SO_SNDBUF, &so_buf, sizeof(so_buf));
+        }
+    }
+
+    if (ret != 0) {
+        lb_router_ctx_release(ctx);
+    }
+
+    return ret;
+}
+
+int quic_lb_router(picoquic_quic_config_t* config, char const* backend_list)
+{
+    lb_router_ctx_t ctx;
+    uint64_t current_time = picoquic_current_time();
+    int ret = lb_router_ctx_init(&ctx, config, backend_list, current_time);
+
+    if (ret == 0) {
+        fprintf(stdout, "QUIC-LB router on port %d, %zu backends.\n", config->server_port, ctx.router.nb_backends);
+    }
+
+    while (ret == 0) {
+        size_t nb_fds = 0;
+        size_t nb_backends = ctx.router.nb_backends;
+        size_t nb_flows = ctx.nb_flows;
+        int timeout_ms = LB_ROUTER_POLL_MAX;
+
+        ctx.poll_fds[nb_fds].fd = ctx.listen_fd;
+        ctx.poll_fds[nb_fds++].events = POLLIN;
+        for (size_t i = 0; i < nb_backends; i++) {
+            ctx.poll_fds[nb_fds].fd = ctx.probe_fd[i];
+            ctx.poll_fds[nb_fds++].events = POLLIN;
+        }
+        for (size_t i = 0; i < nb_flows; i++) {
+            ctx.poll_fds[nb_fds].fd = ctx.flows[i]->fd;
+            ctx.poll_fds[nb_fds++].events = POLLIN;
+        }
+        for (size_t i = 0; i < nb_fds; i++) {
+            ctx.poll_fds[i].revents = 0;
+        }
+
+        if (poll(ctx.poll_fds, (nfds_t)nb_fds, timeout_ms) < 0 && errno != EINTR) {
+            fprintf(stderr, "Poll error: %d\n", errno);
+            ret = -1;
+            break;
+        }
+        current_time = picoquic_current_time();
+
+        /* Relay the replies first, since new flows may be created by the
+         * forwarding of client packets and change the flow table. */
+        for (size_t i = 0; i < nb_flows; i++) {
+            if ((ctx.poll_fds[1 + nb_backends + i].revents & POLLIN) != 0) {
+                lb_router_forward_to_client(&ctx, ctx.flows[i], current_time);
+            }
+        }
+        for (size_t i = 0; i < nb_backends; i++) {
+            if ((ctx.poll_fds[1 + i].revents & POLLIN) != 0) {
+                while (lb_router_recv_batch(ctx.probe_fd[i], ctx.batch) > 0) {
+                    for (int j = 0; j < ctx.batch->nb; j++) {
+                        (void)picoquic_lb_router_process_probe_response(&ctx.router,
+                            ctx.batch->buffer[j], ctx.batch->length[j], current_time);
+                    }
+                }
+            }
+        }
+        if ((ctx.poll_fds[0].revents & POLLIN) != 0) {
+            lb_router_forward_to_backends(&ctx, current_time);
+        }
+        lb_router_health_checks(&ctx, current_time);
+    }
+
+    if (ctx.batch != NULL) {
+        fprintf(stdout, "Routed %" PRIu64 " packets by server ID, %" PRIu64 " by hash, dropped %" PRIu64 ", refused %" PRIu64 " flows.\n",
+            ctx.router.nb_routed_by_id, ctx.router.nb_routed_by_hash, ctx.router.nb_dropped, ctx.nb_flows_refused);
+        lb_router_ctx_release(&ctx);
+    }
+
+    return ret;
+}
+
+#else
+#include <stdio.h>
+#include "picoquic.h"
+#include "picoquic_config.h"
+#include "lb_router.h"
+
+int quic_lb_router(picoquic_quic_config_t* config, char const* backend_list)
+{
+    UNREFERENCED_PARAMETER(config);
+    UNREFERENCED_PARAMETER(backend_list);
+    fprintf(stderr, "The QUIC-LB router mode is not supported on Windows.\n");
+    return -1;
+}
+#endif
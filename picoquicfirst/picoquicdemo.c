@@ -71,6 +71,7 @@ static const char* token_store_filename = "demo_token_store.bin";
 #include "h3zero_common.h"
 #include "pico_webtransport.h"
 #include "wt_baton.h"
+#include "connect_udp.h"
 #include "democlient.h"
 #include "demoserver.h"
 #include "quicperf.h"
@@ -80,6 +81,7 @@ static const char* token_store_filename = "demo_token_store.bin";
 #include "performance_log.h"
 #include "picoquic_config.h"
 #include "picoquic_lb.h"
+#include "lb_router.h"
 #ifdef PICOQUIC_MEMORY_LOG
 #include "auto_memlog.h"
 #endif
@@ -102,11 +104,45 @@ void print_address(FILE* F_log, struct sockaddr* address, char* label, picoquic_
     }
 }
 
+/* CPU utilisation of a network thread, updated from the loop callback
+ * at most once per second, and read from the main thread. */
+typedef struct st_demo_thread_cpu_t {
+    uint64_t cpu_start;
+    uint64_t wall_start;
+    uint64_t next_update;
+    volatile uint64_t cpu_used;
+    volatile uint64_t wall_used;
+} demo_thread_cpu_t;
+
+static void demo_thread_cpu_start(demo_thread_cpu_t* cpu)
+{
+    cpu->cpu_start = picoquic_thread_cpu_time();
+    cpu->wall_start = picoquic_current_time();
+    cpu->next_update = cpu->wall_start + 1000000;
+}
+
+static void demo_thread_cpu_update(demo_thread_cpu_t* cpu, uint64_t current_time, int force)
+{
+    if (force || current_time >= cpu->next_update) {
+        uint64_t now = picoquic_current_time();
+        cpu->cpu_used = picoquic_thread_cpu_time() - cpu->cpu_start;
+        cpu->wall_used = now - cpu->wall_start;
+        cpu->next_update = now + 1000000;
+    }
+}
+
+static double demo_thread_cpu_percent(uint64_t cpu_used, uint64_t wall_used)
+{
+    return (wall_used == 0) ? 0.0 : (100.0 * (double)cpu_used) / (double)wall_used;
+}
+
 /* server loop call back management */
 typedef struct st_server_loop_cb_t {
     int just_once;
     int first_connection_seen;
     int connection_done;
+    connect_udp_proxy_t* proxy;
+    demo_thread_cpu_t cpu;
 } server_loop_cb_t;
 
 static int server_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
@@ -122,12 +158,22 @@ static int server_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb
         switch (cb_mode) {
         case picoquic_packet_loop_ready:
             fprintf(stdout, "Waiting for packets.\n");
+            demo_thread_cpu_start(&cb_ctx->cpu);
+            if (cb_ctx->proxy != NULL && callback_arg != NULL) {
+                /* The proxy flow sockets are polled at least once per interval */
+                ((picoquic_packet_loop_options_t*)callback_arg)->do_time_check = 1;
+            }
             break;
         case picoquic_packet_loop_after_receive:
-            break;
         case picoquic_packet_loop_after_send:
+            (void)connect_udp_proxy_poll(cb_ctx->proxy, picoquic_get_quic_time(quic));
+            demo_thread_cpu_update(&cb_ctx->cpu, picoquic_get_quic_time(quic), 0);
+            break;
+        case picoquic_packet_loop_time_check:
+            connect_udp_proxy_time_check(cb_ctx->proxy, &((packet_loop_time_check_arg_t*)callback_arg)->delta_t);
             break;
         case picoquic_packet_loop_port_update:
+        case picoquic_packet_loop_wake_up:
             break;
         default:
             ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
@@ -264,7 +310,7 @@ int demoserver_post_callback(picoquic_cnx_t* cnx,
     return ret;
 }
 
-picohttp_server_path_item_t path_item_list[2] =
+picohttp_server_path_item_t path_item_list[3] =
 {
     {
         "/post",
@@ -277,10 +323,17 @@ picohttp_server_path_item_t path_item_list[2] =
         6,
         wt_baton_callback,
         NULL
+    },
+    {
+        CONNECT_UDP_PATH,
+        sizeof(CONNECT_UDP_PATH) - 1,
+        connect_udp_callback,
+        NULL,
+        1
     }
 };
 
-int quic_server(const char* server_name, picoquic_quic_config_t * config, int just_once)
+int quic_server(const char* server_name, picoquic_quic_config_t * config, int just_once, size_t nb_proxy_flows)
 {
     /* Start: start the QUIC process with cert and key files */
     int ret = 0;
@@ -289,12 +342,25 @@ int quic_server(const char* server_name, picoquic_quic_config_t * config, int ju
     picohttp_server_parameters_t picoquic_file_param;
     server_loop_cb_t loop_cb_ctx;
 
+    memset(&loop_cb_ctx, 0, sizeof(server_loop_cb_t));
     memset(&picoquic_file_param, 0, sizeof(picohttp_server_parameters_t));
     picoquic_file_param.web_folder = config->www_dir;
     picoquic_file_param.path_table = path_item_list;
     picoquic_file_param.path_table_nb = 2;
+    if (nb_proxy_flows > 0) {
+        /* Accept CONNECT-UDP requests */
+        loop_cb_ctx.proxy = connect_udp_proxy_create(nb_proxy_flows, 0, 0);
+        path_item_list[2].path_app_ctx = loop_cb_ctx.proxy;
+        picoquic_file_param.path_table_nb = 3;
+    }
+    picoquic_file_param.path_router = h3zero_path_router_create(path_item_list, picoquic_file_param.path_table_nb);
+    if (config->www_dir != NULL) {
+        /* Serve the small static files from a cache of complete responses,
+         * and the larger ones from a cache of memory mapped files */
+        picoquic_file_param.response_cache = h3zero_response_cache_create(0, 0, 0);
+        picoquic_file_param.file_cache = h3zero_file_cache_create(0, 0);
+    }
 
-    memset(&loop_cb_ctx, 0, sizeof(server_loop_cb_t));
     loop_cb_ctx.just_once = just_once;
 
     /* Setup the server context */
@@ -369,10 +435,153 @@ int quic_server(const char* server_name, picoquic_quic_config_t * config, int ju
     if (qserver != NULL) {
         picoquic_free(qserver);
     }
+    h3zero_file_cache_delete(picoquic_file_param.file_cache);
+    h3zero_response_cache_delete(picoquic_file_param.response_cache);
+    h3zero_path_router_delete(picoquic_file_param.path_router);
+    connect_udp_proxy_delete(loop_cb_ctx.proxy);
 
     return ret;
 }
 
+/* Sharded server: one QUIC context and one network thread per shard,
+ * see picoquic_start_sharded_server. Each shard has its own HTTP server
+ * parameters and caches, which are not shared between threads. The main
+ * thread reports the CPU utilisation of the shards every 10 seconds.
+ */
+typedef struct st_server_shard_ctx_t {
+    picohttp_server_parameters_t file_param;
+    server_loop_cb_t loop_cb;
+    uint64_t reported_cpu;
+    uint64_t reported_wall;
+} server_shard_ctx_t;
+
+static void demo_sleep_msec(int msec)
+{
+#ifdef _WINDOWS
+    Sleep(msec);
+#else
+    usleep(msec * 1000);
+#endif
+}
+
+int quic_sharded_server(const char* server_name, picoquic_quic_config_t* config, int nb_shards)
+{
+    int ret = 0;
+    picoquic_quic_group_t* group = NULL;
+    picoquic_sharded_server_t* sharded_server = NULL;
+    server_shard_ctx_t* shard_ctx = NULL;
+    void** loop_ctx = NULL;
+    picoquic_packet_loop_param_t param = { 0 };
+
+    if (config->cnx_id_cbdata != NULL) {
+        fprintf(stderr, "The sharded server sets its own CID policy, cannot use: %s.\n", config->cnx_id_cbdata);
+        ret = -1;
+    }
+    else if (config->performance_log != NULL) {
+        fprintf(stderr, "The performance log is not supported by the sharded server.\n");
+        ret = -1;
+    }
+    else if ((shard_ctx = (server_shard_ctx_t*)malloc(nb_shards * sizeof(server_shard_ctx_t))) == NULL ||
+        (loop_ctx = (void**)malloc(nb_shards * sizeof(void*))) == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        memset(shard_ctx, 0, nb_shards * sizeof(server_shard_ctx_t));
+        if (config->ticket_file_name == NULL) {
+            ret = picoquic_config_set_option(config, picoquic_option_Ticket_File_Name, ticket_store_filename);
+        }
+        if (ret == 0 && config->token_file_name == NULL) {
+            ret = picoquic_config_set_option(config, picoquic_option_Token_File_Name, token_store_filename);
+        }
+        if (ret == 0 && (group = picoquic_create_and_configure_group(nb_shards, config, picoquic_demo_server_callback, NULL,
+            picoquic_current_time(), NULL)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < nb_shards; i++) {
+        picoquic_quic_t* quic = picoquic_quic_group_shard(group, i);
+        picohttp_server_parameters_t* file_param = &shard_ctx[i].file_param;
+
+        file_param->web_folder = config->www_dir;
+        file_param->path_table = path_item_list;
+        file_param->path_table_nb = 2;
+        file_param->path_router = h3zero_path_router_create(path_item_list, file_param->path_table_nb);
+        if (config->www_dir != NULL) {
+            file_param->response_cache = h3zero_response_cache_create(0, 0, 0);
+            file_param->file_cache = h3zero_file_cache_create(0, 0);
+        }
+        loop_ctx[i] = &shard_ctx[i].loop_cb;
+
+        picoquic_set_default_callback(quic, picoquic_demo_server_callback, file_param);
+        picoquic_set_key_log_file_from_env(quic);
+        picoquic_set_alpn_select_fn(quic, picoquic_demo_server_callback_select_alpn);
+        picoquic_use_unique_log_names(quic, 1);
+        if (config->qlog_dir != NULL) {
+            picoquic_set_qlog(quic, config->qlog_dir);
+        }
+    }
+
+    if (ret == 0) {
+        param.local_port = (uint16_t)config->server_port;
+        param.dest_if = config->dest_if;
+        param.socket_buffer_size = config->socket_buffer_size;
+        param.do_not_use_gso = config->do_not_use_gso;
+
+        sharded_server = picoquic_start_sharded_server(nb_shards, &param, picoquic_quic_group_shard_create, group,
+            server_loop_cb, loop_ctx, &ret);
+        if (sharded_server == NULL && ret == 0) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        int is_closed = 0;
+        int nb_ticks = 0;
+
+        fprintf(stdout, "Server running on %d shards.\n", nb_shards);
+        while (!is_closed) {
+            demo_sleep_msec(100);
+            for (int i = 0; i < nb_shards; i++) {
+                if (sharded_server->thread_ctx[i]->thread_is_closed) {
+                    fprintf(stdout, "Shard %d exit, ret = 0x%x\n", i, sharded_server->thread_ctx[i]->return_code);
+                    ret = sharded_server->thread_ctx[i]->return_code;
+                    is_closed = 1;
+                }
+            }
+            if (++nb_ticks >= 100) {
+                /* Report the CPU utilisation over the last interval */
+                nb_ticks = 0;
+                for (int i = 0; i < nb_shards; i++) {
+                    uint64_t cpu_used = shard_ctx[i].loop_cb.cpu.cpu_used;
+                    uint64_t wall_used = shard_ctx[i].loop_cb.cpu.wall_used;
+
+                    fprintf(stdout, "Shard %d: cpu %.1f%%\n", i,
+                        demo_thread_cpu_percent(cpu_used - shard_ctx[i].reported_cpu, wall_used - shard_ctx[i].reported_wall));
+                    shard_ctx[i].reported_cpu = cpu_used;
+                    shard_ctx[i].reported_wall = wall_used;
+                }
+            }
+        }
+    }
+
+    /* Clean up */
+    picoquic_delete_sharded_server(sharded_server);
+    picoquic_delete_quic_group(group);
+    if (shard_ctx != NULL) {
+        for (int i = 0; i < nb_shards; i++) {
+            h3zero_file_cache_delete(shard_ctx[i].file_param.file_cache);
+            h3zero_response_cache_delete(shard_ctx[i].file_param.response_cache);
+            h3zero_path_router_delete(shard_ctx[i].file_param.path_router);
+        }
+        free(shard_ctx);
+    }
+    if (loop_ctx != NULL) {
+        free(loop_ctx);
+    }
+    return ret;
+}
+
 static const char * test_scenario_default = "0:index.html;4:test.html;8:/1234567;12:main.jpg;16:war-and-peace.txt;20:en/latest/;24:/file-123K";
 
 /* Client loop call back management.
@@ -391,6 +600,7 @@ static const char * test_scenario_default = "0:index.html;4:test.html;8:/1234567
 typedef struct st_client_loop_cb_t {
     picoquic_cnx_t* cnx_client;
     picoquic_demo_callback_ctx_t* demo_callback_ctx;
+    picoquic_demo_pipeline_t* pipeline;
     int notified_ready;
     int established;
     int migration_to_preferred_started;
@@ -764,7 +974,22 @@ int client_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
                     }
                 }
 
-                if (!cb_ctx->is_quicperf && cb_ctx->demo_callback_ctx->nb_open_streams == 0) {
+                if (!cb_ctx->is_quicperf && cb_ctx->pipeline != NULL) {
+                    if (picoquic_demo_pipeline_is_done(cb_ctx->pipeline)) {
+                        fprintf(stdout, "All done, Closing the connections.\n");
+                        picoquic_log_app_message(cb_ctx->cnx_client, "%s", "All done, Closing the connections.");
+                        for (size_t i = 0; ret == 0 && i < cb_ctx->pipeline->nb_cnx; i++) {
+                            if (cb_ctx->pipeline->cnx[i] != cb_ctx->cnx_client &&
+                                picoquic_get_cnx_state(cb_ctx->pipeline->cnx[i]) < picoquic_state_disconnecting) {
+                                ret = picoquic_close(cb_ctx->pipeline->cnx[i], 0);
+                            }
+                        }
+                        if (ret == 0) {
+                            ret = picoquic_close(cb_ctx->cnx_client, 0);
+                        }
+                    }
+                }
+                else if (!cb_ctx->is_quicperf && cb_ctx->demo_callback_ctx->nb_open_streams == 0) {
                     fprintf(stdout, "All done, Closing the connection.\n");
                     picoquic_log_app_message(cb_ctx->cnx_client, "%s", "All done, Closing the connection.");
 
@@ -815,7 +1040,8 @@ int client_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
 /* Quic Client */
 int quic_client(const char* ip_address_text, int server_port, 
     picoquic_quic_config_t * config, int force_migration,
-    int nb_packets_before_key_update, char const * client_scenario_text)
+    int nb_packets_before_key_update, char const * client_scenario_text, char const* json_report_file,
+    char const* pipeline_spec, char const* timing_file_name)
 {
     /* Start: start the QUIC process with cert and key files */
     int ret = 0;
@@ -832,6 +1058,10 @@ int quic_client(const char* ip_address_text, int server_port,
     client_loop_cb_t loop_cb;
     picoquic_packet_loop_param_t param = { 0 };
     const char* sni = config->sni;
+    picoquic_demo_pipeline_t* pipeline = NULL;
+    FILE* timing_file = NULL;
+    size_t nb_extra_cnx = 0;
+    picoquic_demo_callback_ctx_t* extra_ctx = NULL;
 
     memset(&loop_cb, 0, sizeof(client_loop_cb_t));
 
@@ -924,6 +1154,38 @@ int quic_client(const char* ip_address_text, int server_port,
                 ret = picoquic_demo_client_initialize_context(&callback_ctx, client_sc, client_sc_nb, config->alpn, config->no_disk, 0);
                 callback_ctx.out_dir = config->out_dir;
             }
+
+            if (ret == 0 && pipeline_spec != NULL) {
+                /* Pipelined mode, "concurrent[:connections]" */
+                unsigned long max_concurrent = 0;
+                unsigned long nb_cnx = 1;
+                if (sscanf(pipeline_spec, "%lu:%lu", &max_concurrent, &nb_cnx) < 1 || max_concurrent == 0 ||
+                    nb_cnx == 0 || nb_cnx > PICOQUIC_DEMO_PIPELINE_MAX_CNX) {
+                    fprintf(stdout, "Invalid pipeline specification: %s\n", pipeline_spec);
+                    ret = -1;
+                }
+                else if (timing_file_name != NULL && (timing_file = picoquic_file_open(timing_file_name, "w")) == NULL) {
+                    fprintf(stdout, "Cannot open the timing file: %s\n", timing_file_name);
+                    ret = -1;
+                }
+                else if ((pipeline = picoquic_demo_pipeline_create((size_t)max_concurrent, (size_t)nb_cnx, timing_file)) == NULL ||
+                    (nb_cnx > 1 && (extra_ctx = (picoquic_demo_callback_ctx_t*)malloc(
+                        sizeof(picoquic_demo_callback_ctx_t) * (nb_cnx - 1))) == NULL)) {
+                    fprintf(stdout, "Cannot allocate the pipeline.\n");
+                    ret = -1;
+                }
+                else {
+                    fprintf(stdout, "Pipelined mode, %lu concurrent requests over %lu connections.\n", max_concurrent, nb_cnx);
+                    callback_ctx.pipeline = pipeline;
+                    nb_extra_cnx = (size_t)nb_cnx - 1;
+                    for (size_t i = 0; ret == 0 && i < nb_extra_cnx; i++) {
+                        ret = picoquic_demo_client_initialize_context(&extra_ctx[i], client_sc, client_sc_nb, config->alpn, config->no_disk, 0);
+                        extra_ctx[i].out_dir = config->out_dir;
+                        extra_ctx[i].no_print = 1;
+                        extra_ctx[i].pipeline = pipeline;
+                    }
+                }
+            }
         }
     }
     /* Check that if we are using H3 the SNI is not NULL */
@@ -1007,6 +1269,27 @@ int quic_client(const char* ip_address_text, int server_port,
             }
         }
     }
+    /* Create the additional connections of the pipeline. Their requests are
+     * queued until the handshake completes. */
+    for (size_t i = 0; ret == 0 && i < nb_extra_cnx; i++) {
+        picoquic_cnx_t* cnx = picoquic_create_cnx(qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&loop_cb.server_address, current_time,
+            config->proposed_version, sni, config->alpn, 1);
+
+        if (cnx == NULL) {
+            ret = -1;
+        }
+        else {
+            picoquic_cnx_set_pmtud_policy(cnx, picoquic_pmtud_delayed);
+            picoquic_set_callback(cnx, picoquic_demo_client_callback, &extra_ctx[i]);
+            if (config->desired_version != 0) {
+                picoquic_set_desired_version(cnx, config->desired_version);
+            }
+            if ((ret = picoquic_start_client_cnx(cnx)) == 0) {
+                ret = picoquic_demo_client_start_streams(cnx, &extra_ctx[i], PICOQUIC_DEMO_STREAM_ID_INITIAL);
+            }
+        }
+    }
     /* Wait for packets */
     if (ret == 0) {
         if (config->multipath_alt_config != NULL) {
@@ -1020,6 +1303,7 @@ int quic_client(const char* ip_address_text, int server_port,
         loop_cb.socket_buffer_size = config->socket_buffer_size;
         if (!is_quicperf) {
             loop_cb.demo_callback_ctx = &callback_ctx;
+            loop_cb.pipeline = pipeline;
         }
 
         /* In case needed, program an extra path, so we can simulate multipath or migration */
@@ -1174,6 +1458,13 @@ int quic_client(const char* ip_address_text, int server_port,
                     }
 
                     (void)quicperf_print_report(stdout, quicperf_ctx);
+                    if (json_report_file != NULL) {
+                        FILE* F = picoquic_file_open(json_report_file, "w");
+                        if (F == NULL || quicperf_print_json_report(F, quicperf_ctx) != 0) {
+                            fprintf(stderr, "Could not write the JSON report to <%s>.\n", json_report_file);
+                        }
+                        (void)picoquic_file_close(F);
+                    }
 
                     picoquic_log_app_message(cnx_client, "Received %" PRIu64 " bytes in %f seconds, %f Mbps.",
                         picoquic_get_data_received(cnx_client), duration_usec, ((double)quicperf_ctx->data_received) * 8.0 / duration_usec);
@@ -1220,6 +1511,10 @@ int quic_client(const char* ip_address_text, int server_port,
             }
         }
         
+        if (pipeline != NULL) {
+            (void)picoquic_demo_pipeline_report(stdout, pipeline);
+        }
+
         if (picoquic_is_ech_handshake(cnx_client)) {
             fprintf(stdout, "ECH handshake was successful.\n");
         } else {
@@ -1279,6 +1574,19 @@ int quic_client(const char* ip_address_text, int server_port,
         picoquic_demo_client_delete_context(&callback_ctx);
     }
 
+    if (extra_ctx != NULL) {
+        for (size_t i = 0; i < nb_extra_cnx; i++) {
+            picoquic_demo_client_delete_context(&extra_ctx[i]);
+        }
+        free(extra_ctx);
+    }
+
+    if (pipeline != NULL) {
+        picoquic_demo_pipeline_delete(pipeline);
+    }
+
+    (void)picoquic_file_close(timing_file);
+
     if (loop_cb.saved_alpn != NULL) {
         free((void *)loop_cb.saved_alpn);
         loop_cb.saved_alpn = NULL;
@@ -1291,6 +1599,281 @@ int quic_client(const char* ip_address_text, int server_port,
     return ret;
 }
 
+/* Quicperf load client.
+ * Opens connections to the server at the rate specified in the load spec,
+ * runs the quicperf scenario on each of them, and reports aggregate statistics.
+ * The spec is "rate:max_concurrent:nb_connections[:p]", with the optional
+ * "p" selecting Poisson arrivals instead of a constant rate.
+ *
+ * The load can be spread over several threads, each with its own QUIC context
+ * of a QUIC group, its own sockets and its own load context, running a share
+ * of the arrival rate, of the concurrent connections and of the total.
+ */
+static int quic_load_parse_spec(char const* load_spec, quicperf_load_param_t* load_param)
+{
+    int ret = 0;
+    unsigned long long rate = 0;
+    unsigned long long max_concurrent = 0;
+    unsigned long long nb_connections = 0;
+    char mode[2] = { 0 };
+    int nb_fields = sscanf(load_spec, "%llu:%llu:%llu:%1s", &rate, &max_concurrent, &nb_connections, mode);
+
+    if (nb_fields < 3 || rate == 0 || max_concurrent == 0 ||
+        (nb_fields == 4 && mode[0] != 'p')) {
+        ret = -1;
+    }
+    else {
+        load_param->arrival_rate = (uint64_t)rate;
+        load_param->max_concurrent = (size_t)max_concurrent;
+        load_param->nb_connections = (uint64_t)nb_connections;
+        load_param->is_poisson = (nb_fields == 4);
+    }
+    return ret;
+}
+
+typedef struct st_load_client_thread_t {
+    quicperf_load_ctx_t* load_ctx;
+    picoquic_network_thread_ctx_t* thread_ctx;
+    picoquic_packet_loop_param_t param;
+    demo_thread_cpu_t cpu;
+} load_client_thread_t;
+
+static int load_client_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
+    void* callback_ctx, void* callback_arg)
+{
+    int ret = 0;
+    load_client_thread_t* load_thread = (load_client_thread_t*)callback_ctx;
+
+    if (load_thread == NULL) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else {
+        quicperf_load_ctx_t* load_ctx = load_thread->load_ctx;
+
+        switch (cb_mode) {
+        case picoquic_packet_loop_ready:
+            if (callback_arg != NULL) {
+                picoquic_packet_loop_options_t* options = (picoquic_packet_loop_options_t*)callback_arg;
+                options->do_time_check = 1;
+            }
+            demo_thread_cpu_start(&load_thread->cpu);
+            ret = quicperf_load_step(load_ctx, picoquic_get_quic_time(quic));
+            break;
+        case picoquic_packet_loop_after_receive:
+        case picoquic_packet_loop_after_send:
+            ret = quicperf_load_step(load_ctx, picoquic_get_quic_time(quic));
+            if (ret == 0 && quicperf_load_is_done(load_ctx)) {
+                ret = PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP;
+            }
+            demo_thread_cpu_update(&load_thread->cpu, picoquic_get_quic_time(quic), ret != 0);
+            break;
+        case picoquic_packet_loop_time_check: {
+            packet_loop_time_check_arg_t* time_check_arg = (packet_loop_time_check_arg_t*)callback_arg;
+            uint64_t next_time = quicperf_load_next_time(load_ctx);
+
+            if (next_time <= time_check_arg->current_time) {
+                time_check_arg->delta_t = 0;
+            }
+            else if (next_time - time_check_arg->current_time < (uint64_t)time_check_arg->delta_t) {
+                time_check_arg->delta_t = (int64_t)(next_time - time_check_arg->current_time);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return ret;
+}
+
+/* Share of a value for thread i out of nb_threads */
+static uint64_t quic_load_thread_share(uint64_t total, int i, int nb_threads)
+{
+    return (total / nb_threads) + (((uint64_t)i < total % nb_threads) ? 1 : 0);
+}
+
+int quic_load_client(const char* ip_address_text, int server_port,
+    picoquic_quic_config_t* config, char const* client_scenario_text, char const* load_spec,
+    int nb_threads, char const* json_report_file)
+{
+    int ret = 0;
+    picoquic_quic_group_t* group = NULL;
+    load_client_thread_t* load_thread = NULL;
+    quicperf_load_ctx_t* total = NULL;
+    quicperf_load_param_t load_param;
+    uint64_t current_time = picoquic_current_time();
+    int is_name = 0;
+
+    memset(&load_param, 0, sizeof(quicperf_load_param_t));
+
+    if (quic_load_parse_spec(load_spec, &load_param) != 0) {
+        fprintf(stderr, "Invalid load specification: %s\n", load_spec);
+        ret = -1;
+    }
+    else if (client_scenario_text == NULL) {
+        fprintf(stderr, "The load client requires a quicperf scenario.\n");
+        ret = -1;
+    }
+    else {
+        /* Each thread runs at least one connection at a time */
+        if (nb_threads < 1) {
+            nb_threads = 1;
+        }
+        if ((uint64_t)nb_threads > load_param.arrival_rate) {
+            nb_threads = (int)load_param.arrival_rate;
+        }
+        if ((size_t)nb_threads > load_param.max_concurrent) {
+            nb_threads = (int)load_param.max_concurrent;
+        }
+        if (load_param.nb_connections > 0 && (uint64_t)nb_threads > load_param.nb_connections) {
+            nb_threads = (int)load_param.nb_connections;
+        }
+        if ((load_thread = (load_client_thread_t*)malloc(nb_threads * sizeof(load_client_thread_t))) == NULL ||
+            (total = (quicperf_load_ctx_t*)malloc(sizeof(quicperf_load_ctx_t))) == NULL) {
+            ret = PICOQUIC_ERROR_MEMORY;
+        }
+        else {
+            memset(load_thread, 0, nb_threads * sizeof(load_client_thread_t));
+            memset(total, 0, sizeof(quicperf_load_ctx_t));
+        }
+    }
+
+    if (ret == 0) {
+        ret = picoquic_get_server_address(ip_address_text, server_port, &load_param.server_address, &is_name);
+        load_param.sni = config->sni;
+        if (load_param.sni == NULL && is_name != 0) {
+            load_param.sni = ip_address_text;
+        }
+    }
+
+    if (ret == 0) {
+        if (config->ticket_file_name == NULL) {
+            ret = picoquic_config_set_option(config, picoquic_option_Ticket_File_Name, ticket_store_filename);
+        }
+        if (ret == 0 && config->token_file_name == NULL) {
+            ret = picoquic_config_set_option(config, picoquic_option_Token_File_Name, token_store_filename);
+        }
+        if (ret == 0 && (group = picoquic_create_and_configure_group(nb_threads, config, NULL, NULL, current_time, NULL)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        load_param.scenario_text = client_scenario_text;
+        load_param.alpn = QUICPERF_ALPN;
+        load_param.proposed_version = config->proposed_version;
+        fprintf(stdout, "Opening %" PRIu64 " connections at %" PRIu64 " per second (%s), up to %zu at a time, on %d threads.\n",
+            load_param.nb_connections, load_param.arrival_rate,
+            (load_param.is_poisson) ? "poisson" : "constant", load_param.max_concurrent, nb_threads);
+    }
+
+    for (int i = 0; ret == 0 && i < nb_threads; i++) {
+        picoquic_quic_t* quic = picoquic_quic_group_shard(group, i);
+        quicperf_load_param_t thread_param = load_param;
+        picoquic_tp_t client_tp;
+
+        picoquic_set_key_log_file_from_env(quic);
+        if (config->qlog_dir != NULL) {
+            picoquic_set_qlog(quic, config->qlog_dir);
+        }
+        if (i == 0 && config->performance_log != NULL) {
+            ret = picoquic_perflog_setup(quic, config->performance_log);
+        }
+        picoquic_set_default_pmtud_policy(quic, picoquic_pmtud_delayed);
+        memcpy(&client_tp, picoquic_get_default_tp(quic), sizeof(picoquic_tp_t));
+        client_tp.max_datagram_frame_size = 1532;
+        (void)picoquic_set_default_tp(quic, &client_tp);
+
+        thread_param.arrival_rate = quic_load_thread_share(load_param.arrival_rate, i, nb_threads);
+        thread_param.max_concurrent = (size_t)quic_load_thread_share(load_param.max_concurrent, i, nb_threads);
+        thread_param.nb_connections = quic_load_thread_share(load_param.nb_connections, i, nb_threads);
+        thread_param.random_seed = current_time + i;
+        /* Stagger the constant rate arrivals of the threads */
+        load_thread[i].load_ctx = quicperf_load_create(quic, &thread_param,
+            current_time + (i * 1000000ull) / load_param.arrival_rate);
+        if (load_thread[i].load_ctx == NULL) {
+            fprintf(stderr, "Could not create the load context for <%s>.\n", client_scenario_text);
+            ret = -1;
+        }
+        else {
+            load_thread[i].param.local_af = load_param.server_address.ss_family;
+            load_thread[i].param.socket_buffer_size = config->socket_buffer_size;
+            load_thread[i].param.do_not_use_gso = config->do_not_use_gso;
+            load_thread[i].thread_ctx = picoquic_start_network_thread(quic, &load_thread[i].param,
+                load_client_loop_cb, &load_thread[i], &ret);
+            if (load_thread[i].thread_ctx == NULL && ret == 0) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (load_thread != NULL) {
+        /* Wait until all threads are done */
+        for (int i = 0; i < nb_threads; i++) {
+            if (load_thread[i].thread_ctx != NULL) {
+                while (ret == 0 && !load_thread[i].thread_ctx->thread_is_closed) {
+                    demo_sleep_msec(10);
+                }
+                if (ret == 0 && load_thread[i].thread_ctx->return_code != 0) {
+                    fprintf(stderr, "Thread %d exit, ret = 0x%x\n", i, load_thread[i].thread_ctx->return_code);
+                    ret = load_thread[i].thread_ctx->return_code;
+                }
+                picoquic_delete_network_thread(load_thread[i].thread_ctx);
+                load_thread[i].thread_ctx = NULL;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        for (int i = 0; i < nb_threads; i++) {
+            quicperf_load_ctx_t* load_ctx = load_thread[i].load_ctx;
+            uint64_t end_time = (load_ctx->first == NULL) ? load_ctx->end_time : picoquic_current_time();
+            double duration_usec = (double)((end_time > load_ctx->start_time) ? end_time - load_ctx->start_time : 1);
+
+            fprintf(stdout, "Thread %d: cpu %.1f%%, connections %" PRIu64 "/%" PRIu64 ", Download_Mbps: %f\n", i,
+                demo_thread_cpu_percent(load_thread[i].cpu.cpu_used, load_thread[i].cpu.wall_used),
+                load_ctx->nb_completed, load_ctx->nb_arrivals, ((double)load_ctx->data_received) * 8.0 / duration_usec);
+            if (load_ctx->nb_failed > 0) {
+                ret = -1;
+            }
+            quicperf_load_add_statistics(total, load_ctx);
+        }
+
+        (void)quicperf_load_print_report(stdout, total, total->end_time);
+        if (json_report_file != NULL) {
+            FILE* F = picoquic_file_open(json_report_file, "w");
+            if (F == NULL || quicperf_load_print_json_report(F, total, total->end_time) != 0) {
+                fprintf(stderr, "Could not write the JSON report to <%s>.\n", json_report_file);
+            }
+            (void)picoquic_file_close(F);
+        }
+    }
+
+    if (load_thread != NULL) {
+        for (int i = 0; i < nb_threads; i++) {
+            quicperf_load_delete(load_thread[i].load_ctx);
+        }
+        free(load_thread);
+    }
+    if (total != NULL) {
+        free(total);
+    }
+
+    if (group != NULL) {
+        /* Only the first context of the group saves the tickets */
+        picoquic_quic_t* qclient = picoquic_quic_group_shard(group, 0);
+        if (picoquic_save_session_tickets(qclient, config->ticket_file_name) != 0) {
+            fprintf(stderr, "Could not store the saved session tickets to <%s>.\n", config->ticket_file_name);
+        }
+        if (picoquic_save_retry_tokens(qclient, config->token_file_name) != 0) {
+            fprintf(stderr, "Could not save tokens to <%s>.\n", config->token_file_name);
+        }
+        picoquic_delete_quic_group(group);
+    }
+
+    return ret;
+}
+
 /* TODO: rewrite using common code */
 void usage()
 {
@@ -1311,6 +1894,19 @@ void usage()
     fprintf(stderr, "                        -f 3  test migration to new address.\n");
     fprintf(stderr, "  -u nb                 trigger key update after receiving <nb> packets on client\n");
     fprintf(stderr, "  -1                    Once: close the server after processing 1 connection.\n");
+    fprintf(stderr, "  -g \"sid/ip/port[,sid/ip/port]\"  Run as a QUIC-LB router on the server port,\n");
+    fprintf(stderr, "                        forwarding to the listed backends. The server IDs are\n");
+    fprintf(stderr, "                        in hexadecimal, and the CID format is set with -i.\n");
+    fprintf(stderr, "  -Y nb                 Accept up to <nb> CONNECT-UDP proxy flows on the server.\n");
+    fprintf(stderr, "  -Z rate:max:total[:p] Run the quicperf scenario as a load test, opening <total>\n");
+    fprintf(stderr, "                        connections at <rate> per second, at most <max> at a\n");
+    fprintf(stderr, "                        time; \"p\" selects Poisson arrivals.\n");
+    fprintf(stderr, "  -2 file               Write the quicperf report in JSON format to <file>.\n");
+    fprintf(stderr, "  -3 nb                 Use <nb> threads: shards of the server, or threads\n");
+    fprintf(stderr, "                        sharing the load of the -Z client.\n");
+    fprintf(stderr, "  -6 max[:nb_cnx]       Pipeline the scenario requests, keeping at most <max>\n");
+    fprintf(stderr, "                        open, spread over <nb_cnx> connections.\n");
+    fprintf(stderr, "  -7 file               Write the timing of each pipelined request to <file>, CSV.\n");
 
     fprintf(stderr, "\nThe scenario argument specifies the set of files that should be retrieved,\n");
     fprintf(stderr, "and their order. The syntax is:\n");
@@ -1343,6 +1939,13 @@ int main(int argc, char** argv)
     int force_migration = 0;
     int just_once = 0;
     int is_client = 0;
+    char const* router_backends = NULL;
+    int nb_proxy_flows = 0;
+    char const* load_spec = NULL;
+    char const* json_report_file = NULL;
+    char const* pipeline_spec = NULL;
+    char const* timing_file_name = NULL;
+    int nb_threads = 1;
     int ret;
 
 #ifdef _WINDOWS
@@ -1351,8 +1954,15 @@ int main(int argc, char** argv)
 #endif
     picoquic_register_all_congestion_control_algorithms();
     picoquic_config_init(&config);
-    memcpy(option_string, "A:u:f:1", 7);
-    ret = picoquic_config_option_letters(option_string + 7, sizeof(option_string) - 7, NULL);
+    memcpy(option_string, "A:u:f:1g:Y:Z:2:3:6:7:", 21);
+    option_string[21] = 0;
+    ret = picoquic_config_check_option_letters(option_string);
+    if (ret == 0) {
+        ret = picoquic_config_option_letters(option_string + 21, sizeof(option_string) - 21, NULL);
+    }
+    if (ret == 0 && picoquic_config_long_options(&argc, argv, &config) != 0) {
+        usage();
+    }
 
     if (ret == 0) {
         /* Get the parameters */
@@ -1374,6 +1984,33 @@ int main(int argc, char** argv)
             case '1':
                 just_once = 1;
                 break;
+            case 'g':
+                router_backends = optarg;
+                break;
+            case 'Y':
+                if ((nb_proxy_flows = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of proxy flows: %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'Z':
+                load_spec = optarg;
+                break;
+            case '2':
+                json_report_file = optarg;
+                break;
+            case '3':
+                if ((nb_threads = atoi(optarg)) <= 0 || nb_threads > PICOQUIC_SHARDS_MAX) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    usage();
+                }
+                break;
+            case '6':
+                pipeline_spec = optarg;
+                break;
+            case '7':
+                timing_file_name = optarg;
+                break;
             case 'A':
                 config.multipath_alt_config = malloc(sizeof(char) * (strlen(optarg) + 1));
                 memcpy(config.multipath_alt_config, optarg, sizeof(char) * (strlen(optarg) + 1));
@@ -1387,6 +2024,9 @@ int main(int argc, char** argv)
             }
         }
     }
+    else {
+        usage();
+    }
 
     /* Simplified style params */
     if (optind < argc) {
@@ -1409,7 +2049,18 @@ int main(int argc, char** argv)
         usage();
     }
 
-    if (is_client == 0) {
+    if (router_backends != NULL) {
+        if (is_client) {
+            fprintf(stderr, "The router mode does not take a server name.\n");
+            usage();
+        }
+        if (config.server_port == 0) {
+            config.server_port = server_port;
+        }
+        ret = quic_lb_router(&config, router_backends);
+        printf("Router exit with code = %d\n", ret);
+    }
+    else if (is_client == 0) {
         if (config.server_port == 0) {
             config.server_port = server_port;
         }
@@ -1429,14 +2080,30 @@ int main(int argc, char** argv)
         /* Run as server */
         printf("Starting Picoquic server (v%s) on port %d, server name = %s, just_once = %d, do_retry = %d\n",
             PICOQUIC_VERSION, config.server_port, server_name, just_once, config.do_retry);
-        ret = quic_server(server_name, &config, just_once);
+        if (nb_threads > 1) {
+            if (just_once || nb_proxy_flows > 0) {
+                fprintf(stderr, "The -1 and -Y options are not supported with several threads.\n");
+                usage();
+            }
+            ret = quic_sharded_server(server_name, &config, nb_threads);
+        }
+        else {
+            ret = quic_server(server_name, &config, just_once, (size_t)nb_proxy_flows);
+        }
         printf("Server exit with code = %d\n", ret);
     }
+    else if (load_spec != NULL) {
+        /* Run as load client */
+        printf("Starting Picoquic (v%s) load test to server = %s, port = %d\n", PICOQUIC_VERSION, server_name, server_port);
+        ret = quic_load_client(server_name, server_port, &config, client_scenario, load_spec, nb_threads, json_report_file);
+        printf("Load client exit with code = %d\n", ret);
+    }
     else {
         /* Run as client */
         printf("Starting Picoquic (v%s) connection to server = %s, port = %d\n", PICOQUIC_VERSION, server_name, server_port);
         ret = quic_client(server_name, server_port, &config,
-            force_migration, nb_packets_before_update, client_scenario);
+            force_migration, nb_packets_before_update, client_scenario, json_report_file,
+            pipeline_spec, timing_file_name);
 
         printf("Client exit with code = %d\n", ret);
     }
@@ -39,7 +39,8 @@
  */
 
 typedef enum {
-    ackfrq_test_basic = 0
+    ackfrq_test_basic = 0,
+    ackfrq_test_adaptive
 } ackfrq_test_enum;
 
 typedef struct st_ackfrq_test_spec_t {
@@ -53,12 +54,62 @@ typedef struct st_ackfrq_test_spec_t {
     uint64_t max_ack_gap_remote;
     uint64_t min_ack_delay_remote;
     uint64_t target_interval;
+    int is_adaptive;
 } ackfrq_test_spec_t;
 
 static test_api_stream_desc_t test_scenario_ackfrq[] = {
     { 4, 0, 257, 1000000 }
 };
 
+/* Verify the adaptive controller on the server connection: when congestion
+ * control starts probing, an IMMEDIATE_ACK and an update are requested, and
+ * the requested gap is smaller than in steady state. In steady state, the gap
+ * can exceed the default limit of 64 packets.
+ */
+static int ackfrq_adaptive_check(picoquic_cnx_t* cnx, uint64_t simulated_time)
+{
+    int ret = 0;
+    uint64_t ack_gap_probing;
+    uint64_t ack_gap_steady;
+    uint64_t ack_delay_max;
+    uint8_t buffer[16];
+    uint8_t* bytes;
+    int more_data = 0;
+    int is_pure_ack = 1;
+
+    picoquic_set_congestion_algorithm(cnx, picoquic_cubic_algorithm);
+    cnx->path[0]->cwin = 1000 * cnx->path[0]->send_mtu;
+    cnx->path[0]->is_ssthresh_initialized = 1;
+    cnx->is_ack_frequency_probing = 0;
+    cnx->is_immediate_ack_pending = 0;
+    picoquic_compute_ack_gap_and_delay(cnx, cnx->path[0]->rtt_min, cnx->remote_parameters.min_ack_delay,
+        cnx->path[0]->bandwidth_estimate, &ack_gap_steady, &ack_delay_max);
+
+    cnx->path[0]->is_ssthresh_initialized = 0;
+    picoquic_adaptive_ack_frequency_update(cnx, simulated_time);
+    picoquic_compute_ack_gap_and_delay(cnx, cnx->path[0]->rtt_min, cnx->remote_parameters.min_ack_delay,
+        cnx->path[0]->bandwidth_estimate, &ack_gap_probing, &ack_delay_max);
+
+    if (!cnx->is_ack_frequency_probing || !cnx->is_immediate_ack_pending || !cnx->is_ack_frequency_updated) {
+        DBG_PRINTF("%s", "Probing start not detected");
+        ret = -1;
+    }
+    else if (ack_gap_steady <= 64 || ack_gap_probing >= ack_gap_steady) {
+        DBG_PRINTF("Ack gap steady %" PRIu64 ", probing %" PRIu64, ack_gap_steady, ack_gap_probing);
+        ret = -1;
+    }
+    else {
+        bytes = picoquic_format_immediate_ack_if_pending(cnx, buffer, buffer + sizeof(buffer), &more_data, &is_pure_ack);
+        if (bytes != buffer + 1 || buffer[0] != picoquic_frame_type_immediate_ack ||
+            cnx->is_immediate_ack_pending || is_pure_ack) {
+            DBG_PRINTF("%s", "Immediate ACK not formatted");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
 static int ackfrq_test_one(ackfrq_test_spec_t * spec)
 {
     uint64_t simulated_time = 0;
@@ -78,6 +129,8 @@ static int ackfrq_test_one(ackfrq_test_spec_t * spec)
     if (ret == 0) {
         picoquic_set_default_congestion_algorithm(test_ctx->qserver, spec->ccalgo);
         picoquic_set_congestion_algorithm(test_ctx->cnx_client, spec->ccalgo);
+        picoquic_set_adaptive_ack_frequency(test_ctx->qserver, spec->is_adaptive);
+        picoquic_set_adaptive_ack_frequency(test_ctx->qclient, spec->is_adaptive);
 
         test_ctx->c_to_s_link->microsec_latency = spec->latency;
         test_ctx->s_to_c_link->microsec_latency = spec->latency;
@@ -156,7 +209,7 @@ static int ackfrq_test_one(ackfrq_test_spec_t * spec)
         ret = -1;
     }
 
-    if (ret == 0) {
+    if (ret == 0 && spec->target_interval > 0) {
         uint64_t duration = simulated_time - test_ctx->cnx_server->start_time;
         uint64_t interval = duration / test_ctx->cnx_server->nb_packets_received;
         uint64_t interval_min = interval - (interval >> 2);
@@ -168,6 +221,10 @@ static int ackfrq_test_one(ackfrq_test_spec_t * spec)
         }
     }
 
+    if (ret == 0 && spec->is_adaptive) {
+        ret = ackfrq_adaptive_check(test_ctx->cnx_server, simulated_time);
+    }
+
     /* Verify that the average time between ACK is close to expectations */
     /* Delete the context */
     if (test_ctx != NULL) {
@@ -207,4 +264,21 @@ int ackfrq_short_test()
     spec.target_interval = 1000;
 
     return ackfrq_test_one(&spec);
-}
\ No newline at end of file
+}
+
+int ackfrq_adaptive_test()
+{
+    ackfrq_test_spec_t spec = { 0 };
+    spec.test_id = ackfrq_test_adaptive;
+    spec.latency = 10000;
+    spec.picosec_per_byte_up = 80000;
+    spec.picosec_per_byte_down = 8000;
+    spec.ccalgo = picoquic_bbr_algorithm;
+    spec.max_ack_delay_remote = 6000;
+    spec.max_ack_gap_remote = 256;
+    spec.min_ack_delay_remote = 6000;
+    spec.target_interval = 0;
+    spec.is_adaptive = 1;
+
+    return ackfrq_test_one(&spec);
+}
@@ -430,5 +430,171 @@ int cc_ns_satellite_test()
     spec.seed_cwin = 3750000;
     spec.seed_rtt = 600010;
 
+/* Verify the CPU cost model. The same download is run twice, first without
+ * CPU costs, then with a client whose receive processing is slower than the
+ * link. The second run must still complete, but take longer.
+ */
+int cc_ns_cpu_cost_test()
+{
+    int ret = 0;
+    picoquic_ns_spec_t spec = { 0 };
+    picoquic_ns_result_t result_free = { 0 };
+    picoquic_ns_result_t result_cpu = { 0 };
+    picoquic_connection_id_t icid = { { 0xcc, 0xc9, 0x00, 0, 0, 0, 0, 0}, 8 };
+    spec.main_cc_algo = picoquic_bbr_algorithm;
+    spec.nb_connections = 1;
+    spec.main_start_time = 0;
+    spec.main_scenario_text = cc_compete_batch_scenario_4M;
+    spec.data_rate_in_gbps = 0.01;
+    spec.latency = 10000;
+    spec.main_target_time = 10000000;
+    spec.queue_delay_max = 40000;
+    spec.icid = icid;
+
+    if ((ret = picoquic_ns_ex(&spec, NULL, &result_free)) != 0) {
+        DBG_PRINTF("Simulation without CPU costs fails, ret = %d", ret);
+    }
+    else if (result_free.client_cpu_time != 0 || result_free.server_cpu_time != 0) {
+        DBG_PRINTF("CPU time %" PRIu64 ", %" PRIu64 " without CPU model",
+            result_free.client_cpu_time, result_free.server_cpu_time);
+        ret = -1;
+    }
+    else {
+        spec.client_cpu.receive_ns = 1500000;
+        spec.client_cpu.send_ns = 100000;
+        spec.client_cpu.crypto_ns = 50000;
+        spec.client_cpu.app_callback_ns = 10000;
+        spec.client_cpu.receive_queue_max = 64;
+        spec.server_cpu.send_ns = 20000;
+        spec.server_cpu.crypto_ns = 10000;
+
+        if ((ret = picoquic_ns_ex(&spec, NULL, &result_cpu)) != 0) {
+            DBG_PRINTF("Simulation with CPU costs fails, ret = %d", ret);
+        }
+        else if (result_cpu.client_cpu_time == 0 || result_cpu.server_cpu_time == 0) {
+            DBG_PRINTF("CPU time not charged, client %" PRIu64 ", server %" PRIu64,
+                result_cpu.client_cpu_time, result_cpu.server_cpu_time);
+            ret = -1;
+        }
+        else if (result_cpu.completion_time <= result_free.completion_time) {
+            DBG_PRINTF("Completion %" PRIu64 " with CPU costs, %" PRIu64 " without",
+                result_cpu.completion_time, result_free.completion_time);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
     return picoquic_ns(&spec, NULL);
-}
\ No newline at end of file
+}
+/* Check the parameter sweep: two CC algorithms, two latencies, with and
+ * without losses, on two threads. Verify that the CSV has one line per
+ * combination, that all simulations succeed, and that the runs with a loss
+ * interval see retransmissions.
+ */
+static char const* cc_ns_sweep_csv = "cc_ns_sweep.csv";
+
+static int cc_ns_sweep_get_field(char const* line, int rank, uint64_t* value)
+{
+    int ret = 0;
+
+    while (rank > 0 && *line != 0) {
+        if (*line == ',') {
+            rank--;
+        }
+        line++;
+    }
+    if (rank > 0) {
+        ret = -1;
+    }
+    else {
+        *value = strtoull(line, NULL, 10);
+    }
+    return ret;
+}
+
+int cc_ns_sweep_test()
+{
+    int ret = 0;
+    picoquic_ns_sweep_t sweep;
+    picoquic_congestion_algorithm_t const* cc_algos[2];
+    uint64_t latencies[2] = { 5000, 20000 };
+    uint64_t loss_intervals[2] = { 0, 200 };
+    picoquic_connection_id_t icid = { { 0xcc, 0x5e, 0xee, 0, 0, 0, 0, 0}, 8 };
+    FILE* F = NULL;
+
+    cc_algos[0] = picoquic_bbr_algorithm;
+    cc_algos[1] = picoquic_cubic_algorithm;
+
+    memset(&sweep, 0, sizeof(sweep));
+    sweep.base_spec.main_start_time = 0;
+    sweep.base_spec.main_scenario_text = cc_compete_batch_scenario_4M;
+    sweep.base_spec.nb_connections = 1;
+    sweep.base_spec.data_rate_in_gbps = 0.01;
+    sweep.base_spec.main_target_time = 10000000;
+    sweep.base_spec.queue_delay_max = 40000;
+    sweep.base_spec.icid = icid;
+    sweep.nb_cc_algos = 2;
+    sweep.cc_algos = cc_algos;
+    sweep.nb_latencies = 2;
+    sweep.latencies = latencies;
+    sweep.nb_loss_intervals = 2;
+    sweep.loss_intervals = loss_intervals;
+    sweep.nb_threads = 2;
+
+    if (picoquic_ns_sweep_size(&sweep) != 8) {
+        DBG_PRINTF("Sweep size %zu instead of 8", picoquic_ns_sweep_size(&sweep));
+        ret = -1;
+    }
+    else if ((F = picoquic_file_open(cc_ns_sweep_csv, "w")) == NULL) {
+        DBG_PRINTF("Cannot open %s", cc_ns_sweep_csv);
+        ret = -1;
+    }
+    else {
+        ret = picoquic_ns_sweep(&sweep, F, stderr);
+        F = picoquic_file_close(F);
+    }
+
+    if (ret == 0) {
+        if ((F = picoquic_file_open(cc_ns_sweep_csv, "r")) == NULL) {
+            DBG_PRINTF("Cannot read %s", cc_ns_sweep_csv);
+            ret = -1;
+        }
+        else {
+            char line[512];
+            int nb_lines = 0;
+
+            while (ret == 0 && fgets(line, sizeof(line), F) != NULL) {
+                if (nb_lines > 0) {
+                    uint64_t loss_interval = 0;
+                    uint64_t run_ret = 0;
+                    uint64_t retransmissions = 0;
+
+                    if (cc_ns_sweep_get_field(line, 5, &loss_interval) != 0 ||
+                        cc_ns_sweep_get_field(line, 7, &run_ret) != 0 ||
+                        cc_ns_sweep_get_field(line, 12, &retransmissions) != 0) {
+                        DBG_PRINTF("Cannot parse line %d: %s", nb_lines, line);
+                        ret = -1;
+                    }
+                    else if (run_ret != 0) {
+                        DBG_PRINTF("Simulation failed, line %d: %s", nb_lines, line);
+                        ret = -1;
+                    }
+                    else if (loss_interval > 0 && retransmissions == 0) {
+                        DBG_PRINTF("No retransmission despite losses, line %d: %s", nb_lines, line);
+                        ret = -1;
+                    }
+                }
+                nb_lines++;
+            }
+            F = picoquic_file_close(F);
+            if (ret == 0 && nb_lines != 9) {
+                DBG_PRINTF("Found %d lines instead of 9", nb_lines);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
@@ -533,6 +533,204 @@ int cleartext_pn_enc_test()
     return ret;
 }
 
+/*
+ * Test that sealing a batch of packets produces the same result as protecting
+ * them one by one, and that the batch open recovers the content.
+ */
+
+#define AEAD_BATCH_TEST_NB 4
+
+int aead_seal_batch_test()
+{
+    int ret = 0;
+    struct sockaddr_in test_addr_c, test_addr_s;
+    picoquic_cnx_t* cnx_client = NULL;
+    picoquic_cnx_t* cnx_server = NULL;
+    picoquic_quic_t* qclient = NULL;
+    picoquic_quic_t* qserver = NULL;
+    char test_server_cert_file[512];
+    char test_server_key_file[512];
+    uint8_t clear_text[AEAD_BATCH_TEST_NB][PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t reference[AEAD_BATCH_TEST_NB][PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t sealed[AEAD_BATCH_TEST_NB][PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t decrypted[AEAD_BATCH_TEST_NB][PICOQUIC_MAX_PACKET_SIZE];
+    size_t reference_length[AEAD_BATCH_TEST_NB];
+    picoquic_protect_batch_item_t items[AEAD_BATCH_TEST_NB];
+    picoquic_packet_header ph[AEAD_BATCH_TEST_NB];
+
+    ret = picoquic_get_input_path(test_server_cert_file, sizeof(test_server_cert_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT);
+
+    if (ret == 0) {
+        ret = picoquic_get_input_path(test_server_key_file, sizeof(test_server_key_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY);
+    }
+
+    if (ret != 0) {
+        DBG_PRINTF("%s", "Cannot set the cert or key file names.\n");
+    }
+    else {
+        qclient = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL,
+            NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        qserver = picoquic_create(8, test_server_cert_file, test_server_key_file,
+            NULL, PICOQUIC_TEST_ALPN, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        if (qclient == NULL || qserver == NULL) {
+            DBG_PRINTF("%s", "Could not create Quic contexts.\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        memset(&test_addr_c, 0, sizeof(struct sockaddr_in));
+        test_addr_c.sin_family = AF_INET;
+        memcpy(&test_addr_c.sin_addr, addr1, 4);
+        test_addr_c.sin_port = 12345;
+
+        cnx_client = picoquic_create_cnx(qclient, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test_addr_c, 0, 0, NULL, PICOQUIC_TEST_ALPN, 1);
+        if (cnx_client == NULL) {
+            DBG_PRINTF("%s", "Could not create client connection context.\n");
+            ret = -1;
+        }
+        else {
+            ret = picoquic_start_client_cnx(cnx_client);
+        }
+    }
+
+    if (ret == 0) {
+        memset(&test_addr_s, 0, sizeof(struct sockaddr_in));
+        test_addr_s.sin_family = AF_INET;
+        memcpy(&test_addr_s.sin_addr, addr2, 4);
+        test_addr_s.sin_port = 4433;
+
+        cnx_server = picoquic_create_cnx(qserver, cnx_client->initial_cnxid, cnx_client->path[0]->first_tuple->p_remote_cnxid->cnx_id,
+            (struct sockaddr*)&test_addr_s, 0,
+            cnx_client->proposed_version, NULL, NULL, 0);
+
+        if (cnx_server == NULL) {
+            DBG_PRINTF("%s", "Could not create server connection context.\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Prepare the packets, and protect them one by one as a reference */
+        void* aead_enc = cnx_client->crypto_context[0].aead_encrypt;
+        void* pn_enc = cnx_client->crypto_context[0].pn_enc;
+
+        memset(items, 0, sizeof(items));
+        for (int i = 0; i < AEAD_BATCH_TEST_NB; i++) {
+            size_t length = 200 + 300 * i;
+            size_t header_length;
+
+            cleartext_aead_packet_init_header(&ph[i], cnx_client->initial_cnxid, 1000 + 17 * i,
+                cnx_client->proposed_version, picoquic_packet_initial);
+            cleartext_aead_init_packet(&ph[i], clear_text[i], length);
+            /* Long header, 4 bytes packet number */
+            clear_text[i][0] = 0xc3;
+            header_length = ph[i].pn_offset + 4;
+
+            memcpy(reference[i], clear_text[i], header_length);
+            reference_length[i] = header_length + picoquic_aead_encrypt_generic(reference[i] + header_length,
+                clear_text[i] + header_length, length - header_length, ph[i].pn, reference[i], header_length, aead_enc);
+            picoquic_protect_packet_header(reference[i], ph[i].pn_offset, 0x0F, pn_enc);
+
+            memcpy(sealed[i], clear_text[i], header_length);
+            items[i].packet = sealed[i];
+            items[i].header_length = header_length;
+            items[i].pn_offset = ph[i].pn_offset;
+            items[i].payload = clear_text[i] + header_length;
+            items[i].payload_length = length - header_length;
+            items[i].sequence_number = ph[i].pn;
+        }
+
+        picoquic_aead_seal_batch(aead_enc, pn_enc, 0, items, AEAD_BATCH_TEST_NB);
+
+        for (int i = 0; ret == 0 && i < AEAD_BATCH_TEST_NB; i++) {
+            picoquic_apply_header_mask(sealed[i], items[i].pn_offset, 0x0F, items[i].mask);
+            if (items[i].packet_length != reference_length[i] ||
+                memcmp(sealed[i], reference[i], reference_length[i]) != 0) {
+                DBG_PRINTF("Sealed packet %d differs from reference", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Remove the protection on the server side. The masks computed with
+         * the ECB context must match those computed one by one. */
+        const uint8_t* samples[AEAD_BATCH_TEST_NB];
+        uint8_t masks[AEAD_BATCH_TEST_NB * 16];
+        uint8_t masks_ecb[AEAD_BATCH_TEST_NB * 16];
+
+        for (int i = 0; i < AEAD_BATCH_TEST_NB; i++) {
+            samples[i] = sealed[i] + items[i].pn_offset + 4;
+        }
+        picoquic_pn_mask_batch(cnx_server->crypto_context[0].pn_dec, NULL, samples, masks, AEAD_BATCH_TEST_NB);
+        if (cnx_server->crypto_context[0].pn_dec_ecb == NULL) {
+            DBG_PRINTF("%s", "No ECB context for the initial header protection");
+            ret = -1;
+        }
+        else {
+            picoquic_pn_mask_batch(cnx_server->crypto_context[0].pn_dec, cnx_server->crypto_context[0].pn_dec_ecb,
+                samples, masks_ecb, AEAD_BATCH_TEST_NB);
+            for (int i = 0; ret == 0 && i < AEAD_BATCH_TEST_NB; i++) {
+                if (memcmp(masks + 16 * i, masks_ecb + 16 * i, 5) != 0) {
+                    DBG_PRINTF("ECB mask %d differs", i);
+                    ret = -1;
+                }
+            }
+        }
+
+        for (int i = 0; i < AEAD_BATCH_TEST_NB; i++) {
+            uint8_t pn_l;
+            uint8_t* mask = masks + 16 * i;
+
+            sealed[i][0] ^= mask[0] & 0x0F;
+            pn_l = (sealed[i][0] & 3) + 1;
+            for (uint8_t j = 0; j < pn_l; j++) {
+                sealed[i][items[i].pn_offset + j] ^= mask[j + 1];
+            }
+            items[i].payload = sealed[i] + items[i].header_length;
+            items[i].payload_length = items[i].packet_length - items[i].header_length;
+            items[i].decrypted = decrypted[i];
+        }
+
+        picoquic_aead_open_batch(cnx_server->crypto_context[0].aead_decrypt, 0, items, AEAD_BATCH_TEST_NB);
+
+        for (int i = 0; ret == 0 && i < AEAD_BATCH_TEST_NB; i++) {
+            size_t clear_length = reference_length[i] - items[i].header_length -
+                picoquic_aead_get_checksum_length(cnx_client->crypto_context[0].aead_encrypt);
+
+            if (memcmp(sealed[i], clear_text[i], items[i].header_length) != 0) {
+                DBG_PRINTF("Header of packet %d not recovered", i);
+                ret = -1;
+            }
+            else if (items[i].decrypted_length != clear_length ||
+                memcmp(decrypted[i], clear_text[i] + items[i].header_length, clear_length) != 0) {
+                DBG_PRINTF("Payload of packet %d not recovered", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (cnx_client != NULL) {
+        picoquic_delete_cnx(cnx_client);
+    }
+
+    if (cnx_server != NULL) {
+        picoquic_delete_cnx(cnx_server);
+    }
+
+    if (qclient != NULL) {
+        picoquic_free(qclient);
+    }
+
+    if (qserver != NULL) {
+        picoquic_free(qserver);
+    }
+
+    return ret;
+}
+
 /* Test vector copied from Kazuho Ohu's test code in quicly -- then changed */
 
 int cleartext_pn_vector_test()
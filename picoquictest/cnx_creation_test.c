@@ -331,4 +331,1343 @@ int create_quic_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
+/*
+ * Object pool test.
+ * - Install a counting allocator, and preallocate some connection contexts.
+ * - Create connections, verify that the preallocated contexts are used first
+ *   and that the statistics are correct.
+ * - Verify that the allocator cannot be changed while objects are in use.
+ * - Delete the connections, verify that the objects return to the pool up
+ *   to the pool size, and that all allocations are freed when the context
+ *   is deleted.
+ */
+typedef struct st_object_pool_test_ctx_t {
+    uint64_t nb_alloc;
+    uint64_t nb_free;
+} object_pool_test_ctx_t;
+
+static void* object_pool_test_alloc(void* allocator_ctx, size_t size)
+{
+    ((object_pool_test_ctx_t*)allocator_ctx)->nb_alloc++;
+    return malloc(size);
+}
+
+static void object_pool_test_free(void* allocator_ctx, void* object, size_t size)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(size);
+#endif
+    ((object_pool_test_ctx_t*)allocator_ctx)->nb_free++;
+    free(object);
+}
+
+#define OBJECT_POOL_TEST_NB_CNX 4
+
+int object_pool_test()
+{
+    int ret = 0;
+    object_pool_test_ctx_t alloc_ctx = { 0 };
+    picoquic_object_pool_stats_t stats;
+    picoquic_cnx_t* test_cnx[OBJECT_POOL_TEST_NB_CNX] = { NULL };
+    struct sockaddr_in test4;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else if (picoquic_set_object_allocator(quic, object_pool_test_alloc, object_pool_test_free, &alloc_ctx) != 0 ||
+        picoquic_preallocate_objects(quic, picoquic_object_cnx, 2) != 0 ||
+        picoquic_preallocate_objects(quic, picoquic_object_type_max, 2) == 0) {
+        DBG_PRINTF("%s", "Cannot set allocator or preallocate objects");
+        ret = -1;
+    }
+    else if (alloc_ctx.nb_alloc != 2) {
+        DBG_PRINTF("Expected 2 allocations, got %" PRIu64, alloc_ctx.nb_alloc);
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < OBJECT_POOL_TEST_NB_CNX; i++) {
+        test_cnx[i] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, 0, 0, NULL, NULL, 1);
+        if (test_cnx[i] == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        if (picoquic_get_object_pool_stats(quic, picoquic_object_cnx, &stats) != 0 ||
+            stats.object_size != sizeof(picoquic_cnx_t) ||
+            stats.nb_in_use != OBJECT_POOL_TEST_NB_CNX ||
+            stats.nb_in_pool != 0 ||
+            stats.nb_alloc != OBJECT_POOL_TEST_NB_CNX ||
+            stats.nb_alloc_from_pool != 2) {
+            DBG_PRINTF("Unexpected cnx pool stats, in use %" PRIst ", in pool %" PRIst ", from pool %" PRIu64,
+                stats.nb_in_use, stats.nb_in_pool, stats.nb_alloc_from_pool);
+            ret = -1;
+        }
+        else if (picoquic_get_object_pool_stats(quic, picoquic_object_path, &stats) != 0 ||
+            stats.nb_in_use != OBJECT_POOL_TEST_NB_CNX) {
+            DBG_PRINTF("Expected %d paths in use, got %" PRIst, OBJECT_POOL_TEST_NB_CNX, stats.nb_in_use);
+            ret = -1;
+        }
+        else if (picoquic_set_object_allocator(quic, NULL, NULL, NULL) == 0) {
+            DBG_PRINTF("%s", "Allocator changed while objects in use");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && picoquic_set_object_pool_size(quic, picoquic_object_cnx, 2) != 0) {
+        ret = -1;
+    }
+
+    for (int i = 0; i < OBJECT_POOL_TEST_NB_CNX; i++) {
+        if (test_cnx[i] != NULL) {
+            picoquic_delete_cnx(test_cnx[i]);
+            test_cnx[i] = NULL;
+        }
+    }
+
+    if (ret == 0) {
+        if (picoquic_get_object_pool_stats(quic, picoquic_object_cnx, &stats) != 0 ||
+            stats.nb_in_use != 0 || stats.nb_in_pool != 2 || stats.nb_in_use_max != OBJECT_POOL_TEST_NB_CNX) {
+            DBG_PRINTF("Unexpected cnx pool stats after delete, in use %" PRIst ", in pool %" PRIst,
+                stats.nb_in_use, stats.nb_in_pool);
+            ret = -1;
+        }
+        else if (picoquic_get_object_pool_stats(quic, picoquic_object_tuple, &stats) != 0 ||
+            stats.nb_in_use != 0 || stats.nb_in_pool == 0) {
+            DBG_PRINTF("Unexpected tuple pool stats after delete, in use %" PRIst ", in pool %" PRIst,
+                stats.nb_in_use, stats.nb_in_pool);
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (ret == 0 && alloc_ctx.nb_alloc != alloc_ctx.nb_free) {
+        DBG_PRINTF("Allocated %" PRIu64 " objects, freed %" PRIu64, alloc_ctx.nb_alloc, alloc_ctx.nb_free);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Verify that queued misc frames are allocated from the smallest size
+ * class that fits, that frames released after sending return to their pool
+ * and are reused, and that frames too large for any class still work.
+ */
+int misc_frame_pool_test()
+{
+    int ret = 0;
+    static const size_t frame_length[] = { 16, PICOQUIC_MISC_FRAME_SMALL_SIZE, 200, 1200, PICOQUIC_MISC_FRAME_LARGE_SIZE + 1 };
+    static const picoquic_object_type_enum frame_class[] = {
+        picoquic_object_misc_frame_small, picoquic_object_misc_frame_small, picoquic_object_misc_frame_medium,
+        picoquic_object_misc_frame_large, picoquic_object_type_max };
+    size_t nb_frames = sizeof(frame_length) / sizeof(size_t);
+    uint8_t frame_bytes[PICOQUIC_MISC_FRAME_LARGE_SIZE + 1];
+    picoquic_object_pool_stats_t stats;
+    struct sockaddr_in test4;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+    memset(frame_bytes, 0x1b, sizeof(frame_bytes));
+
+    if (quic == NULL || (cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&test4, 0, 0, NULL, NULL, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        /* Start from an empty queue */
+        while (cnx->first_misc_frame != NULL) {
+            picoquic_delete_misc_or_dg(cnx, &cnx->first_misc_frame, &cnx->last_misc_frame, cnx->first_misc_frame);
+        }
+    }
+
+    for (int round = 0; ret == 0 && round < 2; round++) {
+        for (size_t i = 0; ret == 0 && i < nb_frames; i++) {
+            if (picoquic_queue_misc_frame(cnx, frame_bytes, frame_length[i], 0, picoquic_packet_context_application) != 0 ||
+                cnx->last_misc_frame->object_type != frame_class[i] || cnx->last_misc_frame->length != frame_length[i] ||
+                memcmp(((uint8_t*)cnx->last_misc_frame) + sizeof(picoquic_misc_frame_header_t), frame_bytes, frame_length[i]) != 0) {
+                DBG_PRINTF("Cannot queue misc frame %zu, round %d", i, round);
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            if (picoquic_get_object_pool_stats(quic, picoquic_object_misc_frame_small, &stats) != 0 ||
+                stats.nb_in_use != 2 || stats.nb_alloc != 2 * (uint64_t)(round + 1) || stats.nb_alloc_from_pool != 2 * (uint64_t)round) {
+                DBG_PRINTF("Unexpected small frame pool stats, in use %" PRIst ", from pool %" PRIu64,
+                    stats.nb_in_use, stats.nb_alloc_from_pool);
+                ret = -1;
+            }
+            else if (picoquic_get_object_pool_stats(quic, picoquic_object_misc_frame_medium, &stats) != 0 ||
+                stats.nb_in_use != 1 || stats.object_size != sizeof(picoquic_misc_frame_header_t) + PICOQUIC_MISC_FRAME_MEDIUM_SIZE) {
+                DBG_PRINTF("Unexpected medium frame pool stats, in use %" PRIst, stats.nb_in_use);
+                ret = -1;
+            }
+            else if (picoquic_get_object_pool_stats(quic, picoquic_object_misc_frame_large, &stats) != 0 ||
+                stats.nb_in_use != 1 || stats.nb_alloc_from_pool != (uint64_t)round) {
+                DBG_PRINTF("Unexpected large frame pool stats, in use %" PRIst, stats.nb_in_use);
+                ret = -1;
+            }
+        }
+        /* Release the frames, as after sending */
+        while (cnx != NULL && cnx->first_misc_frame != NULL) {
+            picoquic_delete_misc_or_dg(cnx, &cnx->first_misc_frame, &cnx->last_misc_frame, cnx->first_misc_frame);
+        }
+        if (ret == 0 && (picoquic_get_object_pool_stats(quic, picoquic_object_misc_frame_small, &stats) != 0 ||
+            stats.nb_in_use != 0 || stats.nb_in_pool != 2)) {
+            DBG_PRINTF("Unexpected small frame pool stats after release, in pool %" PRIst, stats.nb_in_pool);
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify that packets and stream data nodes are allocated from the
+ * proper size class, and that small packets queued for retransmission
+ * are moved to a small buffer.
+ */
+int packet_size_class_test()
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = NULL;
+    struct sockaddr_in test4;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_packet_t* small_packet = picoquic_create_packet_ex(quic, 100);
+        picoquic_packet_t* full_packet = picoquic_create_packet(quic);
+        picoquic_packet_t* jumbo_packet = picoquic_create_packet_ex(quic, PICOQUIC_MAX_PACKET_SIZE + 1);
+
+        if (small_packet == NULL || full_packet == NULL || jumbo_packet == NULL ||
+            small_packet->bytes_max != PICOQUIC_SMALL_PACKET_SIZE ||
+            full_packet->bytes_max != PICOQUIC_MAX_PACKET_SIZE ||
+            jumbo_packet->bytes_max != PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
+            DBG_PRINTF("%s", "Packets not allocated in the expected size class");
+            ret = -1;
+        }
+        picoquic_recycle_packet(quic, small_packet);
+        picoquic_recycle_packet(quic, full_packet);
+        picoquic_recycle_packet(quic, jumbo_packet);
+        if (ret == 0 && (quic->p_first_small_packet != small_packet || quic->p_first_packet != full_packet ||
+            quic->p_first_jumbo_packet != jumbo_packet ||
+            picoquic_create_packet_ex(quic, PICOQUIC_SMALL_PACKET_SIZE) != small_packet ||
+            small_packet->bytes_max != PICOQUIC_SMALL_PACKET_SIZE)) {
+            DBG_PRINTF("%s", "Packets not recycled in the expected pool");
+            ret = -1;
+        }
+        else {
+            picoquic_recycle_packet(quic, small_packet);
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_stream_data_node_t* small_node = picoquic_stream_data_node_alloc_ex(quic, 10);
+        picoquic_stream_data_node_t* full_node = picoquic_stream_data_node_alloc_ex(quic, PICOQUIC_SMALL_PACKET_SIZE + 1);
+        picoquic_stream_data_node_t* jumbo_node = picoquic_stream_data_node_alloc_ex(quic, PICOQUIC_MAX_JUMBO_PACKET_SIZE);
+
+        if (small_node == NULL || full_node == NULL || jumbo_node == NULL ||
+            small_node->data_max != PICOQUIC_SMALL_PACKET_SIZE ||
+            full_node->data_max != PICOQUIC_MAX_PACKET_SIZE ||
+            jumbo_node->data_max != PICOQUIC_MAX_JUMBO_PACKET_SIZE) {
+            DBG_PRINTF("%s", "Data nodes not allocated in the expected size class");
+            ret = -1;
+        }
+        if (small_node != NULL) {
+            picoquic_stream_data_node_recycle(small_node);
+        }
+        if (full_node != NULL) {
+            picoquic_stream_data_node_recycle(full_node);
+        }
+        if (jumbo_node != NULL) {
+            picoquic_stream_data_node_recycle(jumbo_node);
+        }
+        if (ret == 0 && (quic->p_first_small_data_node != small_node || quic->p_first_data_node != full_node ||
+            quic->p_first_jumbo_data_node != jumbo_node)) {
+            DBG_PRINTF("%s", "Data nodes not recycled in the expected pool");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, 0, 0, NULL, NULL, 1);
+        if (cnx == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+        picoquic_packet_t* packet = picoquic_create_packet(quic);
+        picoquic_packet_t* compacted = NULL;
+
+        if (packet == NULL) {
+            ret = -1;
+        }
+        else {
+            packet->ptype = picoquic_packet_1rtt_protected;
+            packet->pc = picoquic_packet_context_application;
+            packet->send_path = cnx->path[0];
+            packet->length = 64;
+            for (size_t i = 0; i < packet->length; i++) {
+                packet->bytes[i] = (uint8_t)i;
+            }
+            picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, packet->length, 0);
+            compacted = picoquic_compact_queued_packet(cnx, cnx->path[0], packet);
+
+            if (compacted == packet || compacted->bytes_max != PICOQUIC_SMALL_PACKET_SIZE ||
+                pkt_ctx->pending_first != compacted || pkt_ctx->pending_last != compacted ||
+                compacted->length != 64 || !compacted->is_queued_for_retransmit ||
+                picoquic_get_cnx_memory_usage(cnx, picoquic_memory_retransmit) != PICOQUIC_PACKET_ALLOC_SIZE(PICOQUIC_SMALL_PACKET_SIZE)) {
+                DBG_PRINTF("%s", "Queued packet not compacted");
+                ret = -1;
+            }
+            for (size_t i = 0; ret == 0 && i < compacted->length; i++) {
+                if (compacted->bytes[i] != (uint8_t)i) {
+                    DBG_PRINTF("Compacted packet differs at byte %" PRIst, i);
+                    ret = -1;
+                }
+            }
+            (void)picoquic_dequeue_retransmit_packet(cnx, pkt_ctx, compacted, 1, 0);
+            if (ret == 0 && (pkt_ctx->pending_first != NULL ||
+                picoquic_get_cnx_memory_usage(cnx, picoquic_memory_retransmit) != 0)) {
+                DBG_PRINTF("%s", "Compacted packet not released");
+                ret = -1;
+            }
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        if (ret == 0 && quic->nb_packets_allocated != quic->nb_packets_in_pool) {
+            DBG_PRINTF("%d packets allocated, %d in pool", quic->nb_packets_allocated, quic->nb_packets_in_pool);
+            ret = -1;
+        }
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify that packets queued for retransmission or for spurious loss
+ * detection can be found by sequence number, that the index grows with
+ * the queue, and that it is disabled when the queue is too wide.
+ */
+static picoquic_packet_t* packet_index_queue(picoquic_cnx_t* cnx, uint64_t sequence_number)
+{
+    picoquic_packet_t* packet = picoquic_create_packet_ex(cnx->quic, 64);
+
+    if (packet != NULL) {
+        packet->ptype = picoquic_packet_1rtt_protected;
+        packet->pc = picoquic_packet_context_application;
+        packet->send_path = cnx->path[0];
+        packet->sequence_number = sequence_number;
+        packet->length = 64;
+        picoquic_queue_for_retransmit(cnx, cnx->path[0], packet, packet->length, 0);
+    }
+    return packet;
+}
+
+int packet_index_test()
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = NULL;
+    struct sockaddr_in test4;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, 0, 0, NULL, NULL, 1);
+        if (cnx == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+        picoquic_packet_t* packet;
+
+        for (uint64_t pn = 1000; ret == 0 && pn < 1200; pn++) {
+            if (packet_index_queue(cnx, pn) == NULL) {
+                ret = -1;
+            }
+        }
+        if (ret == 0 && pkt_ctx->pending_index.nb_slots < 256) {
+            DBG_PRINTF("Index has %" PRIst " slots, expected at least 256", pkt_ctx->pending_index.nb_slots);
+            ret = -1;
+        }
+        /* Move the even packets to the spurious detection queue */
+        packet = pkt_ctx->pending_first;
+        while (ret == 0 && packet != NULL) {
+            picoquic_packet_t* next = packet->packet_next;
+            if (picoquic_packet_index_find(&pkt_ctx->pending_index, packet->sequence_number) != packet) {
+                DBG_PRINTF("Packet %" PRIu64 " not found in index", packet->sequence_number);
+                ret = -1;
+            }
+            else if ((packet->sequence_number & 1) == 0) {
+                (void)picoquic_dequeue_retransmit_packet(cnx, pkt_ctx, packet, 0, 0);
+            }
+            packet = next;
+        }
+        for (uint64_t pn = 1000; ret == 0 && pn < 1200; pn++) {
+            picoquic_packet_t* pending = picoquic_packet_index_find(&pkt_ctx->pending_index, pn);
+            picoquic_packet_t* retransmitted = picoquic_packet_index_find(&pkt_ctx->retransmitted_index, pn);
+            if ((pn & 1) == 0) {
+                if (pending != NULL || retransmitted == NULL || !retransmitted->is_queued_for_spurious_detection) {
+                    DBG_PRINTF("Packet %" PRIu64 " not in the spurious detection index", pn);
+                    ret = -1;
+                }
+            }
+            else if (pending == NULL || retransmitted != NULL || !pending->is_queued_for_retransmit) {
+                DBG_PRINTF("Packet %" PRIu64 " not in the retransmit index", pn);
+                ret = -1;
+            }
+        }
+        /* A queue wider than the index limit disables the index */
+        if (ret == 0 && packet_index_queue(cnx, 1000 + 2 * PICOQUIC_PACKET_INDEX_MAX_SLOTS) == NULL) {
+            ret = -1;
+        }
+        if (ret == 0 && (!pkt_ctx->pending_index.is_disabled ||
+            picoquic_packet_index_find(&pkt_ctx->pending_index, 1001) != NULL)) {
+            DBG_PRINTF("%s", "Index not disabled for a wide queue");
+            ret = -1;
+        }
+        /* Once the queue is empty, the index is used again */
+        while (pkt_ctx->pending_last != NULL) {
+            (void)picoquic_dequeue_retransmit_packet(cnx, pkt_ctx, pkt_ctx->pending_last, 1, 0);
+        }
+        if (ret == 0 && ((packet = packet_index_queue(cnx, 2000)) == NULL ||
+            pkt_ctx->pending_index.is_disabled ||
+            picoquic_packet_index_find(&pkt_ctx->pending_index, 2000) != packet)) {
+            DBG_PRINTF("%s", "Index not enabled after the queue was emptied");
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        if (ret == 0 && quic->nb_packets_allocated != quic->nb_packets_in_pool) {
+            DBG_PRINTF("%d packets allocated, %d in pool", quic->nb_packets_allocated, quic->nb_packets_in_pool);
+            ret = -1;
+        }
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify that the ACK data received during a receive batch is aggregated
+ * in a single sample per path, and processed at the end of the batch.
+ */
+static void ack_batch_add_sample(picoquic_cnx_t* cnx, int epoch, uint64_t sent_time,
+    uint64_t data_acked, uint64_t current_time)
+{
+    picoquic_packet_data_t packet_data;
+
+    memset(&packet_data, 0, sizeof(packet_data));
+    packet_data.nb_path_ack = 1;
+    packet_data.last_ack_delay = sent_time / 1000;
+    packet_data.path_ack[0].acked_path = cnx->path[0];
+    packet_data.path_ack[0].largest_sent_time = sent_time;
+    packet_data.path_ack[0].delivered_prior = sent_time;
+    packet_data.path_ack[0].is_set = 1;
+    packet_data.path_ack[0].data_acked = data_acked;
+    picoquic_ack_batch_add(cnx, cnx->path[0], epoch, current_time, &packet_data);
+}
+
+int ack_batch_test()
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = NULL;
+    struct sockaddr_in test4;
+    uint64_t current_time = 1000000;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, &current_time, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, current_time, 0, NULL, NULL, 1);
+        if (cnx == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Outside of a batch, the data is processed immediately */
+        ack_batch_add_sample(cnx, picoquic_epoch_1rtt, 900000, 1000, current_time);
+        if (cnx->ack_batch.nb_path_ack != 0 || cnx->is_ack_batch_queued) {
+            DBG_PRINTF("%s", "ACK data queued outside of a batch");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Inside a batch, the samples merge and the newest one wins */
+        picoquic_receive_batch_start(quic);
+        ack_batch_add_sample(cnx, picoquic_epoch_1rtt, 910000, 1000, current_time);
+        ack_batch_add_sample(cnx, picoquic_epoch_1rtt, 930000, 1000, current_time);
+        ack_batch_add_sample(cnx, picoquic_epoch_1rtt, 920000, 1000, current_time);
+
+        if (cnx->ack_batch.nb_path_ack != 1 || !cnx->is_ack_batch_queued ||
+            quic->ack_batch_first != cnx) {
+            DBG_PRINTF("%s", "ACK data not queued in the batch");
+            ret = -1;
+        }
+        else if (cnx->ack_batch.path_ack[0].data_acked != 3000 ||
+            cnx->ack_batch.path_ack[0].largest_sent_time != 930000 ||
+            cnx->ack_batch.path_ack[0].delivered_prior != 930000 ||
+            cnx->ack_batch.last_ack_delay != 930) {
+            DBG_PRINTF("Unexpected batch sample, acked %" PRIu64 ", sent at %" PRIu64,
+                cnx->ack_batch.path_ack[0].data_acked, cnx->ack_batch.path_ack[0].largest_sent_time);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* A change of epoch flushes the pending sample */
+        ack_batch_add_sample(cnx, picoquic_epoch_handshake, 940000, 500, current_time);
+        if (cnx->ack_batch.nb_path_ack != 1 || cnx->ack_batch_epoch != picoquic_epoch_handshake ||
+            cnx->ack_batch.path_ack[0].data_acked != 500) {
+            DBG_PRINTF("%s", "Batch not flushed on epoch change");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_receive_batch_end(quic);
+        if (cnx->ack_batch.nb_path_ack != 0 || cnx->is_ack_batch_queued ||
+            quic->ack_batch_first != NULL || quic->is_receive_batch_open) {
+            DBG_PRINTF("%s", "Batch not processed at the end of the receive batch");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Deleting the connection removes it from the batch list */
+        picoquic_receive_batch_start(quic);
+        ack_batch_add_sample(cnx, picoquic_epoch_1rtt, 950000, 1000, current_time);
+        picoquic_delete_cnx(cnx);
+        cnx = NULL;
+        if (quic->ack_batch_first != NULL) {
+            DBG_PRINTF("%s", "Deleted connection still in the batch list");
+            ret = -1;
+        }
+        picoquic_receive_batch_end(quic);
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify that stateless packets are queued in the preallocated ring,
+ * and that the full policies are applied when the ring is full.
+ */
+static void stateless_queue_fill(picoquic_quic_t* quic, size_t nb_packets)
+{
+    for (size_t i = 1; i <= nb_packets; i++) {
+        picoquic_stateless_packet_t* sp = picoquic_create_stateless_packet(quic);
+        if (sp != NULL) {
+            sp->length = i;
+            picoquic_queue_stateless_packet(quic, sp);
+        }
+    }
+}
+
+static int stateless_queue_drain(picoquic_quic_t* quic, size_t first_length, size_t nb_expected, int in_ring)
+{
+    int ret = 0;
+    size_t nb_dequeued = 0;
+    picoquic_stateless_packet_t* sp;
+
+    while (ret == 0 && (sp = picoquic_dequeue_stateless_packet(quic)) != NULL) {
+        int is_in_ring = (sp >= quic->stateless_ring && sp < quic->stateless_ring + quic->stateless_ring_size);
+        if (sp->length != first_length + nb_dequeued || (in_ring && !is_in_ring)) {
+            DBG_PRINTF("Unexpected stateless packet, length %" PRIst ", expected %" PRIst, sp->length, first_length + nb_dequeued);
+            ret = -1;
+        }
+        picoquic_delete_stateless_packet(quic, sp);
+        nb_dequeued++;
+    }
+    if (ret == 0 && (nb_dequeued != nb_expected || picoquic_has_pending_stateless_packet(quic))) {
+        DBG_PRINTF("Dequeued %" PRIst " stateless packets, expected %" PRIst, nb_dequeued, nb_expected);
+        ret = -1;
+    }
+    return ret;
+}
+
+int stateless_queue_test()
+{
+    int ret = 0;
+    const size_t nb_slots = 4;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0 && picoquic_set_stateless_queue(quic, nb_slots, picoquic_stateless_full_drop_new) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        /* A reserved slot that is not queued is just reused */
+        picoquic_stateless_packet_t* sp = picoquic_create_stateless_packet(quic);
+        if (sp == NULL || quic->stateless_ring == NULL) {
+            ret = -1;
+        }
+        else {
+            picoquic_delete_stateless_packet(quic, sp);
+            if (picoquic_has_pending_stateless_packet(quic) || picoquic_create_stateless_packet(quic) != sp) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Drop the new packets when full */
+        stateless_queue_fill(quic, nb_slots + 2);
+        if (picoquic_set_stateless_queue(quic, nb_slots, picoquic_stateless_full_drop_oldest) == 0) {
+            DBG_PRINTF("%s", "Stateless queue changed while packets are queued");
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = stateless_queue_drain(quic, 1, nb_slots, 1);
+        }
+        if (ret == 0 && picoquic_get_nb_stateless_packets_dropped(quic) != 2) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Drop the oldest packets when full */
+        ret = picoquic_set_stateless_queue(quic, nb_slots, picoquic_stateless_full_drop_oldest);
+        if (ret == 0) {
+            stateless_queue_fill(quic, nb_slots + 2);
+        }
+        if (ret == 0) {
+            ret = stateless_queue_drain(quic, 3, nb_slots, 1);
+        }
+        if (ret == 0 && picoquic_get_nb_stateless_packets_dropped(quic) != 4) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Allocate extra packets when full */
+        ret = picoquic_set_stateless_queue(quic, nb_slots, picoquic_stateless_full_allocate);
+        if (ret == 0) {
+            stateless_queue_fill(quic, nb_slots + 2);
+        }
+        if (ret == 0) {
+            ret = stateless_queue_drain(quic, 1, nb_slots + 2, 0);
+        }
+        if (ret == 0 && picoquic_get_nb_stateless_packets_dropped(quic) != 4) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Without ring, all packets are allocated */
+        ret = picoquic_set_stateless_queue(quic, 0, picoquic_stateless_full_drop_new);
+        if (ret == 0) {
+            stateless_queue_fill(quic, nb_slots + 2);
+        }
+        if (ret == 0) {
+            ret = stateless_queue_drain(quic, 1, nb_slots + 2, 0);
+        }
+    }
+
+    if (quic != NULL) {
+        /* Leave packets in the queue, to check that they are freed with the context */
+        (void)picoquic_set_stateless_queue(quic, nb_slots, picoquic_stateless_full_allocate);
+        stateless_queue_fill(quic, nb_slots + 2);
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Check that prewarmed pools serve the first allocations without calling
+ * the allocator, including beyond PICOQUIC_MAX_PACKETS_IN_POOL, and that
+ * the objects carved from huge page slabs stay in the pools.
+ */
+int prewarm_pools_test()
+{
+    int ret = 0;
+    const size_t nb_packets = PICOQUIC_MAX_PACKETS_IN_POOL + 16;
+    const size_t nb_data_nodes = 64;
+    const size_t nb_connections = 4;
+
+    for (int use_huge_pages = 0; ret == 0 && use_huge_pages <= 1; use_huge_pages++) {
+        picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        picoquic_object_pool_stats_t stats;
+
+        if (quic == NULL) {
+            ret = -1;
+        }
+        else if (picoquic_prewarm_pools(quic, nb_packets, nb_data_nodes, nb_connections, use_huge_pages) != 0) {
+            DBG_PRINTF("Cannot prewarm pools, huge pages: %d", use_huge_pages);
+            ret = -1;
+        }
+        else if ((size_t)quic->nb_packets_in_pool != nb_packets || quic->nb_packets_allocated != quic->nb_packets_in_pool ||
+            (size_t)quic->nb_data_nodes_in_pool != nb_data_nodes || quic->nb_data_nodes_allocated != quic->nb_data_nodes_in_pool) {
+            DBG_PRINTF("Unexpected pool content, %d packets, %d data nodes",
+                quic->nb_packets_in_pool, quic->nb_data_nodes_in_pool);
+            ret = -1;
+        }
+        else if (picoquic_get_object_pool_stats(quic, picoquic_object_cnx, &stats) != 0 || stats.nb_in_pool != nb_connections ||
+            picoquic_get_object_pool_stats(quic, picoquic_object_local_cnxid, &stats) != 0 ||
+            stats.nb_in_pool != nb_connections * quic->default_tp.active_connection_id_limit) {
+            DBG_PRINTF("%s", "Connection objects not preallocated");
+            ret = -1;
+        }
+        else {
+            picoquic_packet_t** packets = (picoquic_packet_t**)malloc(nb_packets * sizeof(picoquic_packet_t*));
+            picoquic_stream_data_node_t* stream_data = picoquic_stream_data_node_alloc(quic);
+
+            if (packets == NULL || stream_data == NULL) {
+                ret = -1;
+            }
+            else {
+                for (size_t i = 0; i < nb_packets; i++) {
+                    packets[i] = picoquic_create_packet(quic);
+                    if (packets[i] == NULL) {
+                        ret = -1;
+                    }
+                }
+                if (ret == 0 && ((size_t)quic->nb_packets_allocated != nb_packets || quic->nb_packets_in_pool != 0 ||
+                    quic->nb_data_nodes_allocated != (int)nb_data_nodes ||
+                    picoquic_is_prewarmed(quic, stream_data) != use_huge_pages)) {
+                    DBG_PRINTF("%s", "Allocations not served from the prewarmed pools");
+                    ret = -1;
+                }
+                for (size_t i = 0; i < nb_packets; i++) {
+                    picoquic_recycle_packet(quic, packets[i]);
+                }
+                if (ret == 0 && (size_t)quic->nb_packets_in_pool != nb_packets) {
+                    DBG_PRINTF("Only %d packets back in the pool", quic->nb_packets_in_pool);
+                    ret = -1;
+                }
+            }
+            if (stream_data != NULL) {
+                picoquic_stream_data_node_recycle(stream_data);
+            }
+            if (packets != NULL) {
+                free(packets);
+            }
+        }
+
+        if (quic != NULL) {
+            picoquic_free(quic);
+        }
+    }
+
+    return ret;
+}
+
+/* Verify that the index of paths by unique ID is maintained when paths
+ * are created and deleted, and that the ACK data can be aggregated for
+ * more paths than the inline entries of the packet data.
+ */
+static int path_table_verify(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+
+    for (int i = 0; ret == 0 && i < cnx->nb_paths; i++) {
+        if (cnx->path[i]->cnx_path_index != i ||
+            picoquic_find_path_by_unique_id(cnx, cnx->path[i]->unique_path_id) != i ||
+            picoquic_get_path_id_from_unique(cnx, cnx->path[i]->unique_path_id) != i) {
+            DBG_PRINTF("Path %d, unique id %" PRIu64 " not found", i, cnx->path[i]->unique_path_id);
+            ret = -1;
+        }
+    }
+    if (ret == 0 && (cnx->nb_paths > PICOQUIC_PATH_INDEX_THRESHOLD) != (cnx->path_index.nb_items > 0)) {
+        DBG_PRINTF("Unexpected index with %d paths, %zu items", cnx->nb_paths, cnx->path_index.nb_items);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int path_table_test()
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_packet_t* packet = NULL;
+    struct sockaddr_in test4;
+    uint64_t current_time = 1000000;
+    const int nb_paths_target = 13;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, &current_time, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, current_time, 0, NULL, NULL, 1);
+        if (cnx == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Check the setting of the path limit */
+        if (picoquic_get_max_simultaneous_paths(quic) != PICOQUIC_NB_PATH_TARGET) {
+            ret = -1;
+        }
+        picoquic_set_max_simultaneous_paths(quic, nb_paths_target + 3);
+        if (picoquic_get_max_simultaneous_paths(quic) != nb_paths_target + 3) {
+            ret = -1;
+        }
+        picoquic_set_max_simultaneous_paths(quic, 100000);
+        if (picoquic_get_max_simultaneous_paths(quic) != PICOQUIC_NB_PATH_MAX) {
+            ret = -1;
+        }
+        picoquic_set_max_simultaneous_paths(quic, 0);
+        if (picoquic_get_max_simultaneous_paths(quic) != PICOQUIC_NB_PATH_TARGET) {
+            ret = -1;
+        }
+        if (ret != 0) {
+            DBG_PRINTF("%s", "Path limit not set as expected");
+        }
+    }
+
+    while (ret == 0 && cnx->nb_paths < nb_paths_target) {
+        test4.sin_port++;
+        if (picoquic_create_path(cnx, current_time, NULL, (struct sockaddr*)&test4, 0, UINT64_MAX) < 0) {
+            DBG_PRINTF("Cannot create path %d", cnx->nb_paths);
+            ret = -1;
+        }
+        else {
+            ret = path_table_verify(cnx);
+        }
+    }
+
+    if (ret == 0) {
+        /* Delete paths in the middle of the table */
+        uint64_t deleted_id = cnx->path[7]->unique_path_id;
+
+        picoquic_delete_path(cnx, 7);
+        picoquic_delete_path(cnx, 3);
+        ret = path_table_verify(cnx);
+        if (ret == 0 && picoquic_find_path_by_unique_id(cnx, deleted_id) >= 0) {
+            DBG_PRINTF("%s", "Deleted path still found");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Aggregate ACK data for all paths */
+        picoquic_packet_data_t packet_data;
+
+        memset(&packet_data, 0, sizeof(packet_data));
+        packet = picoquic_create_packet(quic);
+        if (packet == NULL) {
+            ret = -1;
+        }
+        for (int k = 0; ret == 0 && k < 2; k++) {
+            for (int i = 0; i < cnx->nb_paths; i++) {
+                packet->send_path = cnx->path[i];
+                packet->send_time = current_time + k;
+                packet->length = 100 * (i + 1);
+                picoquic_record_ack_packet_data(&packet_data, packet);
+            }
+        }
+        if (ret == 0) {
+            if (packet_data.nb_path_ack != cnx->nb_paths || packet_data.path_ack_more == NULL) {
+                DBG_PRINTF("Recorded %d paths instead of %d", packet_data.nb_path_ack, cnx->nb_paths);
+                ret = -1;
+            }
+            for (int i = 0; ret == 0 && i < packet_data.nb_path_ack; i++) {
+                picoquic_path_ack_data_t* path_ack = PICOQUIC_PACKET_DATA_PATH_ACK(&packet_data, i);
+                if (path_ack->acked_path != cnx->path[i] || path_ack->data_acked != (uint64_t)(200 * (i + 1)) ||
+                    path_ack->largest_sent_time != current_time) {
+                    DBG_PRINTF("Unexpected ACK data for path %d", i);
+                    ret = -1;
+                }
+            }
+        }
+        picoquic_packet_data_release(&packet_data);
+        if (packet_data.path_ack_more != NULL || packet_data.nb_path_ack != 0) {
+            ret = -1;
+        }
+    }
+
+    while (ret == 0 && cnx->nb_paths > 1) {
+        /* Deleting paths eventually drops the index */
+        picoquic_delete_path(cnx, cnx->nb_paths / 2);
+        ret = path_table_verify(cnx);
+    }
+
+    if (packet != NULL) {
+        picoquic_recycle_packet(quic, packet);
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Queue a packet sent on a second path, with a loss check deadline in
+ * the future. Demoting or deleting the path before that deadline must
+ * force a new evaluation of the queue, and the packet must lose its
+ * reference to the deleted path.
+ */
+int loss_check_path_test()
+{
+    int ret = 0;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_packet_t* packet = NULL;
+    picoquic_packet_context_t* pkt_ctx = NULL;
+    struct sockaddr_in test4;
+    uint64_t current_time = 1000000;
+    uint64_t loss_check_time = current_time + 100000;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, current_time, &current_time, NULL, NULL, 0);
+
+    memset(&test4, 0, sizeof(test4));
+    test4.sin_family = AF_INET;
+    test4.sin_port = 4433;
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, current_time, 0, NULL, NULL, 1);
+        if (cnx == NULL) {
+            ret = -1;
+        }
+        else {
+            test4.sin_port++;
+            if (picoquic_create_path(cnx, current_time, NULL, (struct sockaddr*)&test4, 0, UINT64_MAX) < 0 ||
+                cnx->nb_paths != 2) {
+                DBG_PRINTF("%s", "Cannot create the second path");
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        if ((packet = picoquic_create_packet(quic)) == NULL) {
+            ret = -1;
+        }
+        else {
+            pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+            packet->ptype = picoquic_packet_1rtt_protected;
+            packet->pc = picoquic_packet_context_application;
+            packet->send_path = cnx->path[1];
+            packet->send_time = current_time;
+            packet->sequence_number = pkt_ctx->send_sequence++;
+            packet->length = 100;
+            picoquic_queue_for_retransmit(cnx, cnx->path[1], packet, packet->length, current_time);
+            pkt_ctx->loss_check_time = loss_check_time;
+            pkt_ctx->loss_check_sequence = packet->sequence_number;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_demote_path(cnx, 1, current_time, 0, NULL);
+        if (pkt_ctx->loss_check_time != 0) {
+            DBG_PRINTF("%s", "Loss check deadline kept after demoting the path");
+            ret = -1;
+        }
+        pkt_ctx->loss_check_time = loss_check_time;
+    }
+
+    if (ret == 0) {
+        picoquic_delete_path(cnx, 1);
+        if (pkt_ctx->loss_check_time != 0) {
+            DBG_PRINTF("%s", "Loss check deadline kept after deleting the path");
+            ret = -1;
+        }
+        else if (pkt_ctx->pending_first != packet || packet->send_path != NULL) {
+            DBG_PRINTF("%s", "Pending packet still refers to the deleted path");
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify the layout of the connection and path contexts, in the style of
+ * pahole. The fields used for each packet must stay in the first cache
+ * lines of the context, and the packet and ACK contexts must come before
+ * the cold fields. A failure means that a field was added to the hot
+ * section, or that a hot field was moved.
+ */
+#define LAYOUT_CACHE_LINE 64
+#define LAYOUT_FIELD(t, f) { #f, offsetof(t, f), sizeof(((t*)0)->f) }
+
+typedef struct st_layout_field_t {
+    char const* name;
+    size_t offset;
+    size_t size;
+} layout_field_t;
+
+static int layout_check(char const* type_name, const layout_field_t* hot, size_t nb_hot, size_t hot_lines_max,
+    const layout_field_t* ctx, size_t nb_ctx, const layout_field_t* cold, size_t nb_cold)
+{
+    int ret = 0;
+    size_t hot_end = 0;
+    size_t ctx_end = 0;
+
+    for (size_t i = 0; i < nb_hot; i++) {
+        if (hot[i].offset + hot[i].size > hot_end) {
+            hot_end = hot[i].offset + hot[i].size;
+        }
+    }
+    if (hot_end > hot_lines_max * LAYOUT_CACHE_LINE) {
+        DBG_PRINTF("%s hot fields use %zu cache lines, more than %zu", type_name,
+            (hot_end + LAYOUT_CACHE_LINE - 1) / LAYOUT_CACHE_LINE, hot_lines_max);
+        for (size_t i = 0; i < nb_hot; i++) {
+            DBG_PRINTF("    %-32s offset %5zu size %4zu line %3zu", hot[i].name, hot[i].offset, hot[i].size,
+                hot[i].offset / LAYOUT_CACHE_LINE);
+        }
+        ret = -1;
+    }
+
+    /* The packet and ACK contexts are large, they follow the hot fields */
+    for (size_t i = 0; i < nb_ctx; i++) {
+        if (ctx[i].offset + ctx[i].size > ctx_end) {
+            ctx_end = ctx[i].offset + ctx[i].size;
+        }
+    }
+    if (ctx_end < hot_end) {
+        ctx_end = hot_end;
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_cold; i++) {
+        if (cold[i].offset < ctx_end) {
+            DBG_PRINTF("%s cold field %s at offset %zu is in the hot section, which ends at %zu",
+                type_name, cold[i].name, cold[i].offset, ctx_end);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int cnx_layout_test()
+{
+    int ret = 0;
+    const layout_field_t cnx_hot[] = {
+        LAYOUT_FIELD(picoquic_cnx_t, quic),
+        LAYOUT_FIELD(picoquic_cnx_t, cnx_state),
+        LAYOUT_FIELD(picoquic_cnx_t, path),
+        LAYOUT_FIELD(picoquic_cnx_t, nb_paths),
+        LAYOUT_FIELD(picoquic_cnx_t, next_wake_time),
+        LAYOUT_FIELD(picoquic_cnx_t, cnx_wake_node),
+        LAYOUT_FIELD(picoquic_cnx_t, app_wake_time),
+        LAYOUT_FIELD(picoquic_cnx_t, latest_progress_time),
+        LAYOUT_FIELD(picoquic_cnx_t, latest_receive_time),
+        LAYOUT_FIELD(picoquic_cnx_t, idle_timeout),
+        LAYOUT_FIELD(picoquic_cnx_t, callback_fn),
+        LAYOUT_FIELD(picoquic_cnx_t, callback_ctx),
+        LAYOUT_FIELD(picoquic_cnx_t, congestion_alg),
+        LAYOUT_FIELD(picoquic_cnx_t, data_sent),
+        LAYOUT_FIELD(picoquic_cnx_t, data_received),
+        LAYOUT_FIELD(picoquic_cnx_t, maxdata_local),
+        LAYOUT_FIELD(picoquic_cnx_t, maxdata_remote),
+        LAYOUT_FIELD(picoquic_cnx_t, crypto_context)
+    };
+    const layout_field_t cnx_ctx[] = {
+        LAYOUT_FIELD(picoquic_cnx_t, pkt_ctx),
+        LAYOUT_FIELD(picoquic_cnx_t, ack_ctx)
+    };
+    const layout_field_t cnx_cold[] = {
+        LAYOUT_FIELD(picoquic_cnx_t, local_parameters),
+        LAYOUT_FIELD(picoquic_cnx_t, remote_parameters),
+        LAYOUT_FIELD(picoquic_cnx_t, sni),
+        LAYOUT_FIELD(picoquic_cnx_t, registered_icid_addr),
+        LAYOUT_FIELD(picoquic_cnx_t, registered_secret_addr),
+        LAYOUT_FIELD(picoquic_cnx_t, retry_token),
+        LAYOUT_FIELD(picoquic_cnx_t, tls_ctx),
+        LAYOUT_FIELD(picoquic_cnx_t, tls_stream),
+        LAYOUT_FIELD(picoquic_cnx_t, crypto_context_old),
+        LAYOUT_FIELD(picoquic_cnx_t, crypto_context_new),
+        LAYOUT_FIELD(picoquic_cnx_t, f_binlog),
+        LAYOUT_FIELD(picoquic_cnx_t, memlog_ctx)
+    };
+    const layout_field_t path_hot[] = {
+        LAYOUT_FIELD(picoquic_path_t, cnx),
+        LAYOUT_FIELD(picoquic_path_t, first_tuple),
+        LAYOUT_FIELD(picoquic_path_t, cwin),
+        LAYOUT_FIELD(picoquic_path_t, bytes_in_transit),
+        LAYOUT_FIELD(picoquic_path_t, congestion_alg_state),
+        LAYOUT_FIELD(picoquic_path_t, pacing),
+        LAYOUT_FIELD(picoquic_path_t, smoothed_rtt),
+        LAYOUT_FIELD(picoquic_path_t, rtt_variant),
+        LAYOUT_FIELD(picoquic_path_t, retransmit_timer),
+        LAYOUT_FIELD(picoquic_path_t, rtt_min),
+        LAYOUT_FIELD(picoquic_path_t, send_mtu),
+        LAYOUT_FIELD(picoquic_path_t, last_packet_received_at),
+        LAYOUT_FIELD(picoquic_path_t, nb_retransmit),
+        LAYOUT_FIELD(picoquic_path_t, last_sent_time),
+        LAYOUT_FIELD(picoquic_path_t, delivered),
+        LAYOUT_FIELD(picoquic_path_t, bandwidth_estimate),
+        LAYOUT_FIELD(picoquic_path_t, bytes_sent),
+        LAYOUT_FIELD(picoquic_path_t, received)
+    };
+    const layout_field_t path_ctx[] = {
+        LAYOUT_FIELD(picoquic_path_t, ack_ctx),
+        LAYOUT_FIELD(picoquic_path_t, pkt_ctx)
+    };
+    const layout_field_t path_cold[] = {
+        LAYOUT_FIELD(picoquic_path_t, registered_peer_addr),
+        LAYOUT_FIELD(picoquic_path_t, net_id_hash_item),
+        LAYOUT_FIELD(picoquic_path_t, app_path_ctx),
+        LAYOUT_FIELD(picoquic_path_t, observed_address_received),
+        LAYOUT_FIELD(picoquic_path_t, reorder_packet_threshold),
+        LAYOUT_FIELD(picoquic_path_t, rtt_threshold_low),
+        LAYOUT_FIELD(picoquic_path_t, cc_telemetry),
+        LAYOUT_FIELD(picoquic_path_t, ip_client_remote)
+    };
+
+    if (layout_check("picoquic_cnx_t", cnx_hot, sizeof(cnx_hot) / sizeof(layout_field_t), 7,
+        cnx_ctx, sizeof(cnx_ctx) / sizeof(layout_field_t),
+        cnx_cold, sizeof(cnx_cold) / sizeof(layout_field_t)) != 0) {
+        ret = -1;
+    }
+
+    if (layout_check("picoquic_path_t", path_hot, sizeof(path_hot) / sizeof(layout_field_t), 9,
+        path_ctx, sizeof(path_ctx) / sizeof(layout_field_t),
+        path_cold, sizeof(path_cold) / sizeof(layout_field_t)) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Check the clock cache: with the cache enabled, the quic time only moves
+ * when the cache is refreshed or when a packet API is called, and it never
+ * goes backward.
+ */
+int clock_cache_test()
+{
+    int ret = 0;
+    uint8_t send_buffer[PICOQUIC_MAX_PACKET_SIZE];
+    size_t send_length = 0;
+    struct sockaddr_storage addr_to;
+    struct sockaddr_storage addr_from;
+    int if_index = 0;
+    picoquic_connection_id_t log_cid;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else {
+        uint64_t cached_time;
+        uint64_t now;
+
+        picoquic_set_clock_cache(quic, 1);
+        cached_time = picoquic_get_quic_time(quic);
+        /* Wait until the wall time moves */
+        for (int i = 0; i < 1000000 && picoquic_current_time() <= cached_time; i++);
+
+        if (cached_time == 0 || picoquic_get_quic_time(quic) != cached_time) {
+            DBG_PRINTF("%s", "Cached time changed without refresh");
+            ret = -1;
+        }
+        else if ((now = picoquic_refresh_quic_time(quic)) <= cached_time || picoquic_get_quic_time(quic) != now) {
+            DBG_PRINTF("%s", "Cached time not refreshed");
+            ret = -1;
+        }
+        else if (picoquic_prepare_next_packet_ex(quic, now + 1000000, send_buffer, sizeof(send_buffer), &send_length,
+            &addr_to, &addr_from, &if_index, &log_cid, NULL, NULL) != 0 || picoquic_get_quic_time(quic) != now + 1000000) {
+            DBG_PRINTF("%s", "Cached time not updated by prepare");
+            ret = -1;
+        }
+        else if (picoquic_refresh_quic_time(quic) >= now + 1000000 || picoquic_get_quic_time(quic) != now + 1000000) {
+            DBG_PRINTF("%s", "Cached time went backward");
+            ret = -1;
+        }
+        else {
+            picoquic_set_clock_cache(quic, 0);
+            if ((now = picoquic_get_quic_time(quic)) >= cached_time + 1000000) {
+                DBG_PRINTF("%s", "Wall time not used after disabling the cache");
+                ret = -1;
+            }
+        }
+
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Check the stateless reset prefilter: every registered secret must pass
+ * the filter, including after the filter grew, secrets removed from the
+ * filter must not leave false negatives behind, and most random tokens
+ * must be rejected.
+ */
+#define RESET_FILTER_TEST_NB_CNX 1000
+#define RESET_FILTER_TEST_NB_RANDOM 10000
+
+int reset_filter_test()
+{
+    int ret = 0;
+    uint64_t current_time = 0;
+    uint64_t random_context = 0xdeadbeefbabac001ull;
+    picoquic_cnx_t** test_cnx = (picoquic_cnx_t**)malloc(sizeof(picoquic_cnx_t*) * RESET_FILTER_TEST_NB_CNX);
+    picoquic_quic_t* quic = picoquic_create(RESET_FILTER_TEST_NB_CNX, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+        current_time, &current_time, NULL, NULL, 0);
+
+    if (quic == NULL || test_cnx == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(test_cnx, 0, sizeof(picoquic_cnx_t*) * RESET_FILTER_TEST_NB_CNX);
+    }
+
+    for (int i = 0; ret == 0 && i < RESET_FILTER_TEST_NB_CNX; i++) {
+        struct sockaddr_in test4;
+
+        memset(&test4, 0, sizeof(test4));
+        test4.sin_family = AF_INET;
+        test4.sin_addr.s_addr = htonl(0x0A000001 + i);
+        test4.sin_port = htons(4433);
+
+        test_cnx[i] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test4, current_time, 0, NULL, NULL, 1);
+        if (test_cnx[i] == NULL || test_cnx[i]->path[0]->first_tuple->p_remote_cnxid == NULL) {
+            DBG_PRINTF("Cannot create connection %d", i);
+            ret = -1;
+        }
+        else {
+            picoquic_test_random_bytes(&random_context, test_cnx[i]->path[0]->first_tuple->p_remote_cnxid->reset_secret,
+                PICOQUIC_RESET_SECRET_SIZE);
+            if (picoquic_register_net_secret(test_cnx[i]) != 0) {
+                DBG_PRINTF("Cannot register secret %d", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0 && (quic->reset_filter.is_disabled || quic->reset_filter.nb_entries != RESET_FILTER_TEST_NB_CNX ||
+        quic->reset_filter.bucket_mask + 1 < RESET_FILTER_TEST_NB_CNX / PICOQUIC_RESET_FILTER_BUCKET_SIZE)) {
+        DBG_PRINTF("Unexpected filter state, %zu entries, %zu buckets",
+            quic->reset_filter.nb_entries, quic->reset_filter.bucket_mask + 1);
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < RESET_FILTER_TEST_NB_CNX; i++) {
+        if (!picoquic_reset_filter_check(quic, test_cnx[i]->registered_reset_secret)) {
+            DBG_PRINTF("False negative for secret %d", i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Remove every other connection, then check the remaining ones */
+        for (int i = 0; i < RESET_FILTER_TEST_NB_CNX; i += 2) {
+            picoquic_delete_cnx(test_cnx[i]);
+            test_cnx[i] = NULL;
+        }
+        if (quic->reset_filter.nb_entries != RESET_FILTER_TEST_NB_CNX / 2) {
+            DBG_PRINTF("Expected %d entries, got %zu", RESET_FILTER_TEST_NB_CNX / 2, quic->reset_filter.nb_entries);
+            ret = -1;
+        }
+        for (int i = 1; ret == 0 && i < RESET_FILTER_TEST_NB_CNX; i += 2) {
+            if (!picoquic_reset_filter_check(quic, test_cnx[i]->registered_reset_secret) ||
+                picoquic_cnx_by_secret(quic, test_cnx[i]->registered_reset_secret,
+                (struct sockaddr*)&test_cnx[i]->registered_secret_addr) != test_cnx[i]) {
+                DBG_PRINTF("Secret %d not found after deletions", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        uint8_t token[PICOQUIC_RESET_SECRET_SIZE];
+        uint64_t nb_rejects_before = picoquic_get_nb_reset_filter_rejects(quic);
+        uint64_t nb_rejects;
+
+        for (int i = 0; i < RESET_FILTER_TEST_NB_RANDOM; i++) {
+            picoquic_test_random_bytes(&random_context, token, sizeof(token));
+            (void)picoquic_reset_filter_check(quic, token);
+        }
+        nb_rejects = picoquic_get_nb_reset_filter_rejects(quic) - nb_rejects_before;
+        /* Expected false positive rate is well below 1% */
+        if (nb_rejects < RESET_FILTER_TEST_NB_RANDOM - RESET_FILTER_TEST_NB_RANDOM / 100) {
+            DBG_PRINTF("Only %" PRIu64 " random tokens rejected out of %d", nb_rejects, RESET_FILTER_TEST_NB_RANDOM);
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+    if (test_cnx != NULL) {
+        free(test_cnx);
+    }
+
+    return ret;
+}
@@ -909,11 +909,18 @@ cnx_stress_ctx_t* cnx_stress_create_ctx(uint64_t duration, int nb_clients, int l
     return stress_ctx;
 }
 
-int cnx_stress_do_test(uint64_t duration, int nb_clients, int do_report)
+static int cnx_stress_do_test_ex(uint64_t duration, int nb_clients, int do_report, int use_timer_wheel)
 {
     int ret = 0;
     cnx_stress_ctx_t* stress_ctx = cnx_stress_create_ctx(duration, nb_clients, 0);
 
+    if (stress_ctx != NULL && use_timer_wheel) {
+        ret = picoquic_set_timer_wheel(stress_ctx->qclient, 1);
+        if (ret == 0) {
+            ret = picoquic_set_timer_wheel(stress_ctx->qserver, 1);
+        }
+    }
+
     if (stress_ctx != NULL) {
         uint64_t wall_time_start = picoquic_current_time();
 
@@ -963,6 +970,11 @@ int cnx_stress_do_test(uint64_t duration, int nb_clients, int do_report)
     return ret;
 }
 
+int cnx_stress_do_test(uint64_t duration, int nb_clients, int do_report)
+{
+    return cnx_stress_do_test_ex(duration, nb_clients, do_report, 0);
+}
+
 /* The unit test entry point executes the cnx stress test with a 
  * small duration and a small number of clients, the goal being to check that
  * the cnx stress code actually works. */
@@ -971,6 +983,13 @@ int cnx_stress_unit_test()
     return cnx_stress_do_test(120000000, 100, 0);
 }
 
+/* Same as the cnx stress unit test, but with the connection wake up times
+ * managed by the timer wheel instead of the splay tree. */
+int cnx_wheel_test()
+{
+    return cnx_stress_do_test_ex(120000000, 100, 0, 1);
+}
+
 /*Connection limit
  * Test that if one attempts to create more than the set limit of
  * connections, it fails. This is complementary to the cnx_stress
@@ -1032,4 +1051,567 @@ int cnx_limit_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
+
+/* Connection racing.
+ * The client races an IPv6 and an IPv4 connection to the same server.
+ * If packets sent to the IPv6 address are lost, the IPv4 connection started
+ * after the race delay wins, and the first connection is kept by the stack
+ * because it belongs to the application. If the IPv6 path works, the first
+ * connection wins before the delay, and the IPv4 connection never sends
+ * anything and is deleted by the stack.
+ */
+#define RACE_CNX_DELAY 100000
+
+typedef struct st_race_cnx_test_ctx_t {
+    uint64_t simulated_time;
+    picoquic_quic_t* qclient;
+    picoquic_quic_t* qserver;
+    picoquictest_sim_link_t* link_to_server;
+    picoquictest_sim_link_t* link_to_client;
+    struct sockaddr_storage server_addr[2]; /* IPv6, then IPv4 */
+    struct sockaddr_storage client_addr[2];
+    int is_v6_broken;
+    int nb_sent[2];
+} race_cnx_test_ctx_t;
+
+static int race_cnx_test_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(bytes);
+    UNREFERENCED_PARAMETER(length);
+    UNREFERENCED_PARAMETER(fin_or_event);
+    UNREFERENCED_PARAMETER(callback_ctx);
+    UNREFERENCED_PARAMETER(v_stream_ctx);
+#endif
+    return 0;
+}
+
+static void race_cnx_test_set_addr(struct sockaddr_storage* addr, int is_v6, uint8_t host, uint16_t port)
+{
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if (is_v6) {
+        struct sockaddr_in6* a6 = (struct sockaddr_in6*)addr;
+        const uint8_t prefix[4] = { 0x20, 0x01, 0x0d, 0xb8 };
+        a6->sin6_family = AF_INET6;
+        memcpy(&a6->sin6_addr, prefix, sizeof(prefix));
+        ((uint8_t*)&a6->sin6_addr)[15] = host;
+        a6->sin6_port = htons(port);
+    }
+    else {
+        struct sockaddr_in* a4 = (struct sockaddr_in*)addr;
+        uint8_t* a_bytes = (uint8_t*)&a4->sin_addr;
+        a4->sin_family = AF_INET;
+        a_bytes[0] = 10;
+        a_bytes[3] = host;
+        a4->sin_port = htons(port);
+    }
+}
+
+static int race_cnx_test_prepare(race_cnx_test_ctx_t* race_ctx, int is_client)
+{
+    int ret = 0;
+    picoquictest_sim_packet_t* packet = picoquictest_sim_link_create_packet();
+
+    if (packet == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_connection_id_t log_cid;
+        picoquic_cnx_t* last_cnx;
+        int if_index = 0;
+
+        ret = picoquic_prepare_next_packet((is_client) ? race_ctx->qclient : race_ctx->qserver,
+            race_ctx->simulated_time, packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length,
+            &packet->addr_to, &packet->addr_from, &if_index, &log_cid, &last_cnx);
+
+        if (ret == 0 && packet->length > 0) {
+            int family_index = (packet->addr_to.ss_family == AF_INET6) ? 0 : 1;
+
+            if (packet->addr_from.ss_family == AF_UNSPEC) {
+                picoquic_store_addr(&packet->addr_from, (struct sockaddr*)((is_client) ?
+                    &race_ctx->client_addr[family_index] : &race_ctx->server_addr[family_index]));
+            }
+            if (!is_client) {
+                picoquictest_sim_link_submit(race_ctx->link_to_client, packet, race_ctx->simulated_time);
+            }
+            else {
+                race_ctx->nb_sent[family_index]++;
+                if (family_index == 0 && race_ctx->is_v6_broken) {
+                    free(packet);
+                }
+                else {
+                    picoquictest_sim_link_submit(race_ctx->link_to_server, packet, race_ctx->simulated_time);
+                }
+            }
+        }
+        else {
+            free(packet);
+        }
+    }
+    return ret;
+}
+
+static int race_cnx_test_step(race_cnx_test_ctx_t* race_ctx)
+{
+    int ret = 0;
+    int next_event = 0;
+    uint64_t next_time = UINT64_MAX;
+    uint64_t wake_time;
+
+    if ((wake_time = picoquic_get_next_wake_time(race_ctx->qclient, race_ctx->simulated_time)) < next_time) {
+        next_event = 1;
+        next_time = wake_time;
+    }
+    if ((wake_time = picoquic_get_next_wake_time(race_ctx->qserver, race_ctx->simulated_time)) < next_time) {
+        next_event = 2;
+        next_time = wake_time;
+    }
+    if (race_ctx->link_to_server->first_packet != NULL &&
+        race_ctx->link_to_server->first_packet->arrival_time < next_time) {
+        next_event = 3;
+        next_time = race_ctx->link_to_server->first_packet->arrival_time;
+    }
+    if (race_ctx->link_to_client->first_packet != NULL &&
+        race_ctx->link_to_client->first_packet->arrival_time < next_time) {
+        next_event = 4;
+        next_time = race_ctx->link_to_client->first_packet->arrival_time;
+    }
+    if (next_time != UINT64_MAX && next_time > race_ctx->simulated_time) {
+        race_ctx->simulated_time = next_time;
+    }
+
+    switch (next_event) {
+    case 1:
+        ret = race_cnx_test_prepare(race_ctx, 1);
+        break;
+    case 2:
+        ret = race_cnx_test_prepare(race_ctx, 0);
+        break;
+    case 3:
+        ret = cnx_stress_link_arrival(race_ctx->qserver, race_ctx->link_to_server, race_ctx->simulated_time);
+        break;
+    case 4:
+        ret = cnx_stress_link_arrival(race_ctx->qclient, race_ctx->link_to_client, race_ctx->simulated_time);
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    return ret;
+}
+
+static int race_cnx_test_count_cnx(picoquic_quic_t* quic)
+{
+    int nb_cnx = 0;
+    picoquic_cnx_t* next = picoquic_get_first_cnx(quic);
+
+    while (next != NULL) {
+        nb_cnx++;
+        next = picoquic_get_next_cnx(next);
+    }
+    return nb_cnx;
+}
+
+static int race_cnx_test_one(int is_v6_broken)
+{
+    int ret = 0;
+    race_cnx_test_ctx_t race_ctx;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_cnx_t* winner = NULL;
+    char test_server_cert_file[512];
+    char test_server_key_file[512];
+
+    memset(&race_ctx, 0, sizeof(race_ctx));
+    race_ctx.is_v6_broken = is_v6_broken;
+    race_cnx_test_set_addr(&race_ctx.server_addr[0], 1, 1, 4443);
+    race_cnx_test_set_addr(&race_ctx.server_addr[1], 0, 1, 4443);
+    race_cnx_test_set_addr(&race_ctx.client_addr[0], 1, 2, 1234);
+    race_cnx_test_set_addr(&race_ctx.client_addr[1], 0, 2, 1234);
+
+    ret = picoquic_get_input_path(test_server_cert_file, sizeof(test_server_cert_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT);
+    if (ret == 0) {
+        ret = picoquic_get_input_path(test_server_key_file, sizeof(test_server_key_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY);
+    }
+    if (ret == 0) {
+        race_ctx.qclient = picoquic_create(4, NULL, NULL, NULL, CNX_STRESS_ALPN, NULL, NULL, NULL, NULL,
+            NULL, race_ctx.simulated_time, &race_ctx.simulated_time, NULL, NULL, 0);
+        race_ctx.qserver = picoquic_create(4, test_server_cert_file, test_server_key_file,
+            NULL, CNX_STRESS_ALPN, race_cnx_test_callback, NULL, NULL, NULL,
+            NULL, race_ctx.simulated_time, &race_ctx.simulated_time, NULL, NULL, 0);
+        race_ctx.link_to_server = picoquictest_sim_link_create(1.0, 10000, NULL, 20000, 0);
+        race_ctx.link_to_client = picoquictest_sim_link_create(1.0, 10000, NULL, 20000, 0);
+        if (race_ctx.qclient == NULL || race_ctx.qserver == NULL ||
+            race_ctx.link_to_server == NULL || race_ctx.link_to_client == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        cnx = picoquic_create_racing_cnx(race_ctx.qclient, (struct sockaddr*)&race_ctx.server_addr[0],
+            (struct sockaddr*)&race_ctx.server_addr[1], race_ctx.simulated_time, 0,
+            PICOQUIC_TEST_SNI, CNX_STRESS_ALPN, race_cnx_test_callback, NULL, RACE_CNX_DELAY);
+        if (cnx == NULL || race_cnx_test_count_cnx(race_ctx.qclient) != 2 ||
+            picoquic_get_race_winner(cnx) != NULL) {
+            ret = -1;
+        }
+    }
+
+    /* Run until one of the connections is ready */
+    while (ret == 0 && race_ctx.simulated_time < 5000000 &&
+        ((winner = picoquic_get_race_winner(cnx)) == NULL || winner->cnx_state != picoquic_state_ready)) {
+        ret = race_cnx_test_step(&race_ctx);
+    }
+
+    if (ret == 0) {
+        if (winner == NULL || winner->cnx_state != picoquic_state_ready) {
+            DBG_PRINTF("%s", "No connection won the race");
+            ret = -1;
+        }
+        else if (is_v6_broken) {
+            if (winner == cnx || !cnx->is_race_loser || race_ctx.nb_sent[1] == 0 ||
+                race_ctx.simulated_time < RACE_CNX_DELAY) {
+                DBG_PRINTF("%s", "The IPv4 connection should have won the race");
+                ret = -1;
+            }
+        }
+        else if (winner != cnx || race_ctx.nb_sent[1] != 0) {
+            DBG_PRINTF("%s", "The IPv6 connection should have won without starting IPv4");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Let the loser close */
+        uint64_t end_time = race_ctx.simulated_time + 1000000;
+        while (ret == 0 && race_ctx.simulated_time < end_time) {
+            ret = race_cnx_test_step(&race_ctx);
+        }
+        if (ret == 0 && race_cnx_test_count_cnx(race_ctx.qclient) != ((is_v6_broken) ? 2 : 1)) {
+            DBG_PRINTF("Unexpected number of client connections: %d", race_cnx_test_count_cnx(race_ctx.qclient));
+            ret = -1;
+        }
+        if (ret == 0 && winner->cnx_state != picoquic_state_ready) {
+            ret = -1;
+        }
+    }
+
+    if (cnx != NULL && race_ctx.qclient != NULL) {
+        /* Deleting the winner also deletes the loser */
+        picoquic_delete_cnx((winner != NULL) ? winner : cnx);
+        if (ret == 0 && picoquic_get_first_cnx(race_ctx.qclient) != NULL) {
+            ret = -1;
+        }
+    }
+    if (race_ctx.qclient != NULL) {
+        picoquic_free(race_ctx.qclient);
+    }
+    if (race_ctx.qserver != NULL) {
+        picoquic_free(race_ctx.qserver);
+    }
+    if (race_ctx.link_to_server != NULL) {
+        picoquictest_sim_link_delete(race_ctx.link_to_server);
+    }
+    if (race_ctx.link_to_client != NULL) {
+        picoquictest_sim_link_delete(race_ctx.link_to_client);
+    }
+
+    return ret;
+}
+
+int race_cnx_test()
+{
+    int ret = race_cnx_test_one(1);
+
+    if (ret == 0) {
+        ret = race_cnx_test_one(0);
+    }
+    return ret;
+}
+
+/* Egress scheduler test.
+ * Three "bulk" connections and one "interactive" connection are always ready
+ * to send; the two groups shall get the same share of the output, and the
+ * three bulk connections the same share of their group. A connection in a
+ * rate limited priority group is served first, until its credit runs out.
+ */
+#define EGRESS_TEST_ALPN_BULK "bulk"
+#define EGRESS_TEST_ALPN_INTERACTIVE "interactive"
+#define EGRESS_TEST_NB_CNX 5
+#define EGRESS_TEST_TRAIN 1500
+#define EGRESS_TEST_ROUNDS 600
+
+static int egress_test_group_fn(picoquic_cnx_t* cnx, void* group_ctx)
+{
+    return (cnx == (picoquic_cnx_t*)group_ctx) ? 2 : -1;
+}
+
+int egress_scheduler_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 1000000;
+    struct sockaddr_storage server_addr;
+    picoquic_cnx_t* cnx[EGRESS_TEST_NB_CNX];
+    int nb_selected[EGRESS_TEST_NB_CNX];
+    uint64_t group_bytes[3] = { 0, 0, 0 };
+    picoquic_egress_group_stats_t stats;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, EGRESS_TEST_ALPN_BULK, NULL, NULL, NULL, NULL,
+        NULL, simulated_time, &simulated_time, NULL, NULL, 0);
+
+    memset(cnx, 0, sizeof(cnx));
+    memset(nb_selected, 0, sizeof(nb_selected));
+    race_cnx_test_set_addr(&server_addr, 0, 1, 4443);
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+    else if ((ret = picoquic_set_egress_scheduler(quic, 1, NULL, NULL)) == 0 &&
+        (ret = picoquic_set_egress_group(quic, 1, EGRESS_TEST_ALPN_INTERACTIVE, 0, 0, 0, 0)) == 0) {
+        /* Priority group, limited to 2 trains per 100 ms */
+        ret = picoquic_set_egress_group(quic, 2, NULL, 1, 0, 15 * EGRESS_TEST_TRAIN, 2 * EGRESS_TEST_TRAIN);
+    }
+
+    for (int i = 0; ret == 0 && i < EGRESS_TEST_NB_CNX; i++) {
+        cnx[i] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&server_addr, simulated_time, 0, PICOQUIC_TEST_SNI,
+            (i == 3) ? EGRESS_TEST_ALPN_INTERACTIVE : EGRESS_TEST_ALPN_BULK, 1);
+        if (cnx[i] == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* The last connection is classified by the callback */
+        ret = picoquic_set_egress_scheduler(quic, 1, egress_test_group_fn, cnx[4]);
+    }
+
+    /* Simulate connections that send one train each time they are selected */
+    for (int round = 0; ret == 0 && round < EGRESS_TEST_ROUNDS; round++) {
+        picoquic_cnx_t* selected = picoquic_egress_select(quic, simulated_time);
+        int group_id;
+
+        if (selected == NULL) {
+            ret = -1;
+            break;
+        }
+        group_id = selected->egress_group;
+        for (int i = 0; i < EGRESS_TEST_NB_CNX; i++) {
+            if (cnx[i] == selected) {
+                nb_selected[i]++;
+            }
+        }
+        if (round < 2 && selected != cnx[4]) {
+            DBG_PRINTF("Round %d, priority connection not served first", round);
+            ret = -1;
+        }
+        picoquic_reinsert_by_wake_time(quic, selected, simulated_time);
+        picoquic_egress_charge(quic, group_id, EGRESS_TEST_TRAIN, simulated_time);
+        group_bytes[group_id] += EGRESS_TEST_TRAIN;
+    }
+
+    if (ret == 0) {
+        uint64_t share_delta = (group_bytes[0] > group_bytes[1]) ? group_bytes[0] - group_bytes[1] : group_bytes[1] - group_bytes[0];
+
+        if (nb_selected[4] != 2 || share_delta > PICOQUIC_EGRESS_QUANTUM_DEFAULT + EGRESS_TEST_TRAIN) {
+            DBG_PRINTF("Unfair shares: bulk %" PRIu64 ", interactive %" PRIu64 ", priority %d trains",
+                group_bytes[0], group_bytes[1], nb_selected[4]);
+            ret = -1;
+        }
+        for (int i = 1; ret == 0 && i < 3; i++) {
+            if (nb_selected[i] > nb_selected[0] + 1 || nb_selected[i] + 1 < nb_selected[0]) {
+                DBG_PRINTF("Connection %d selected %d times, connection 0 %d times", i, nb_selected[i], nb_selected[0]);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Only the rate limited connection is left ready */
+        for (int i = 0; i < 4; i++) {
+            picoquic_reinsert_by_wake_time(quic, cnx[i], UINT64_MAX);
+        }
+        if (picoquic_egress_select(quic, simulated_time) != NULL ||
+            picoquic_get_egress_group_stats(quic, 2, &stats) != 0 ||
+            stats.nb_ready != 1 || stats.nb_rate_limited == 0 || stats.bytes_sent != 2 * EGRESS_TEST_TRAIN) {
+            DBG_PRINTF("%s", "Priority group not rate limited");
+            ret = -1;
+        }
+        else {
+            uint64_t next_time = picoquic_get_next_wake_time(quic, simulated_time);
+
+            if (next_time <= simulated_time || next_time > simulated_time + 100000) {
+                DBG_PRINTF("Unexpected wake time, %" PRIu64 " after current time", next_time - simulated_time);
+                ret = -1;
+            }
+            else {
+                simulated_time = next_time;
+                if (picoquic_egress_select(quic, simulated_time) != cnx[4]) {
+                    DBG_PRINTF("%s", "Priority connection not served after credit refill");
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* A queued connection can be deleted, and disabling the scheduler puts
+         * the ready connections back in the wake list */
+        picoquic_delete_cnx(cnx[4]);
+        cnx[4] = NULL;
+        picoquic_reinsert_by_wake_time(quic, cnx[0], simulated_time);
+        if (picoquic_egress_select(quic, simulated_time) != cnx[0] || !cnx[0]->is_egress_queued ||
+            picoquic_get_egress_group_stats(quic, 2, &stats) != 0 || stats.nb_ready != 0) {
+            ret = -1;
+        }
+        else if (picoquic_set_egress_scheduler(quic, 0, NULL, NULL) != 0 || quic->egress != NULL ||
+            cnx[0]->is_egress_queued || picoquic_get_earliest_cnx_to_wake(quic, simulated_time) != cnx[0]) {
+            DBG_PRINTF("%s", "Ready connections not restored after disabling the scheduler");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Congestion manager test. Connections to the same /24 prefix share a group,
+ * in which the aggregate window is split by weight and the pacing budget is
+ * shared. A connection that joins a group with measurements is seeded with
+ * the RTT of the group and its share of the window.
+ */
+#define CC_MANAGER_TEST_CWIN 400000
+
+int congestion_manager_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 1000000;
+    struct sockaddr_storage server_addr[4];
+    picoquic_cnx_t* cnx[4];
+    picoquic_congestion_manager_stats_t stats;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, PICOQUIC_TEST_ALPN, NULL, NULL, NULL, NULL,
+        NULL, simulated_time, &simulated_time, NULL, NULL, 0);
+
+    memset(cnx, 0, sizeof(cnx));
+    race_cnx_test_set_addr(&server_addr[0], 0, 1, 4443);
+    race_cnx_test_set_addr(&server_addr[1], 0, 2, 4443);
+    race_cnx_test_set_addr(&server_addr[2], 1, 1, 4443);
+    race_cnx_test_set_addr(&server_addr[3], 0, 3, 4443);
+
+    if (quic == NULL || picoquic_set_congestion_manager(quic, 1, 24, 0) != 0) {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        cnx[i] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&server_addr[i], simulated_time, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, 1);
+        if (cnx[i] == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (picoquic_get_congestion_manager_stats(quic, &stats) != 0 || stats.nb_groups != 2 ||
+        cnx[0]->path[0]->cc_group == NULL || cnx[0]->path[0]->cc_group != cnx[1]->path[0]->cc_group ||
+        cnx[2]->path[0]->cc_group == cnx[0]->path[0]->cc_group || stats.nb_seeded != 0)) {
+        DBG_PRINTF("%s", "Paths not grouped by prefix");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        /* The first connection has measurements, the next one inherits them */
+        picoquic_path_t* path_x = cnx[0]->path[0];
+
+        path_x->rtt_is_initialized = 1;
+        path_x->smoothed_rtt = 20000;
+        path_x->rtt_min = 18000;
+        path_x->cwin = CC_MANAGER_TEST_CWIN;
+        cnx[3] = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&server_addr[3], simulated_time, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, 1);
+        if (cnx[3] == NULL) {
+            ret = -1;
+        }
+        else if (cnx[3]->path[0]->cc_group != path_x->cc_group || cnx[3]->seed_cwin != CC_MANAGER_TEST_CWIN / 3 ||
+            cnx[3]->seed_rtt_min != 18000 || cnx[3]->path[0]->smoothed_rtt != 20000 ||
+            picoquic_get_congestion_manager_stats(quic, &stats) != 0 || stats.nb_seeded != 1) {
+            DBG_PRINTF("New connection not seeded, cwin %" PRIu64, cnx[3]->seed_cwin);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Weights 3, 1, 1: the shares are 240000, 80000 and 80000 */
+        uint64_t next_time = UINT64_MAX;
+
+        simulated_time += 10000;
+        picoquic_set_congestion_manager_weight(cnx[0], 3);
+        cnx[0]->path[0]->bytes_in_transit = 300000;
+        cnx[1]->path[0]->bytes_in_transit = 100000;
+        if (!picoquic_cc_manager_is_blocked(cnx[0]->path[0], simulated_time, &next_time) ||
+            !picoquic_cc_manager_is_blocked(cnx[1]->path[0], simulated_time, &next_time) ||
+            picoquic_cc_manager_is_blocked(cnx[3]->path[0], simulated_time, &next_time) ||
+            picoquic_cc_manager_is_blocked(cnx[2]->path[0], simulated_time, &next_time)) {
+            DBG_PRINTF("%s", "Aggregate window not shared by weight");
+            ret = -1;
+        }
+        else {
+            /* Under its share, or below the aggregate window, a path may send */
+            cnx[1]->path[0]->bytes_in_transit = 50000;
+            if (picoquic_cc_manager_is_blocked(cnx[0]->path[0], simulated_time, &next_time) ||
+                picoquic_cc_manager_is_blocked(cnx[1]->path[0], simulated_time, &next_time)) {
+                DBG_PRINTF("%s", "Paths blocked below the aggregate window");
+                ret = -1;
+            }
+        }
+        cnx[0]->path[0]->bytes_in_transit = 0;
+        cnx[1]->path[0]->bytes_in_transit = 0;
+    }
+
+    if (ret == 0) {
+        /* The pacing budget is shared: once a path used it, the others wait */
+        uint64_t next_time = UINT64_MAX;
+        int nb_sent = 0;
+
+        cnx[0]->path[0]->pacing.rate = 10000000;
+        simulated_time += 10000;
+        while (nb_sent < 100 && !picoquic_cc_manager_is_blocked(cnx[3]->path[0], simulated_time, &next_time)) {
+            picoquic_update_pacing_after_send(cnx[3]->path[0], cnx[3]->path[0]->send_mtu, simulated_time);
+            nb_sent++;
+        }
+        if (nb_sent < 2 || nb_sent > 32 || next_time <= simulated_time || next_time > simulated_time + 2000 ||
+            !picoquic_cc_manager_is_blocked(cnx[1]->path[0], simulated_time, &next_time)) {
+            DBG_PRINTF("Group pacing not applied, %d packets sent", nb_sent);
+            ret = -1;
+        }
+        else if (picoquic_cc_manager_is_blocked(cnx[1]->path[0], next_time, &next_time)) {
+            DBG_PRINTF("%s", "Group pacing not refilled");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Groups are deleted with their last member, and disabling the manager removes all groups */
+        picoquic_delete_cnx(cnx[2]);
+        cnx[2] = NULL;
+        if (picoquic_get_congestion_manager_stats(quic, &stats) != 0 || stats.nb_groups != 1 ||
+            cnx[0]->path[0]->cc_group->nb_members != 3) {
+            ret = -1;
+        }
+        else if (picoquic_set_congestion_manager(quic, 0, 0, 0) != 0 || quic->cc_manager != NULL ||
+            cnx[0]->path[0]->cc_group != NULL || cnx[3]->path[0]->cc_group != NULL) {
+            DBG_PRINTF("%s", "Groups not removed after disabling the manager");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
@@ -32,9 +32,9 @@
 #include "picoquic_bbr.h"
 
 #ifdef PICOQUIC_WITHOUT_SSLKEYLOG
-static char* ref_option_text = "c:k:p:v:o:w:x:rR:s:XS:G:H:P:O:Me:C:i:l:Lb:q:m:n:a:t:zI:d:DQT:N:B:F:VU:0j:W:J:E:y:K:h";
+static char* ref_option_text = "c:k:p:v:o:w:x:rR:s:XS:G:H:P:O:Me:C:i:l:Lb:q:m:n:a:t:zI:d:DQT:N:B:F:VU:0j:W:J:E:y:K:4:5:h";
 #else
-static char* ref_option_text = "c:k:p:v:o:w:x:rR:s:XS:G:H:P:O:Me:C:i:l:Lb:q:m:n:a:t:zI:d:DQT:N:B:F:VU:0j:W:8J:E:y:K:h";
+static char* ref_option_text = "c:k:p:v:o:w:x:rR:s:XS:G:H:P:O:Me:C:i:l:Lb:q:m:n:a:t:zI:d:DQT:N:B:F:VU:0j:W:8J:E:y:K:4:5:h";
 #endif
 int config_option_letters_test()
 {
@@ -48,6 +48,15 @@ int config_option_letters_test()
         DBG_PRINTF("picoquic_config_option_letters returns %s", option_text);
         ret = -1;
     }
+    else if (picoquic_config_check_option_letters("A:u:f:1g:Y:Z:2:3:6:7:") != 0 ||
+        picoquic_config_check_option_letters("Y:") != 0) {
+        DBG_PRINTF("%s", "Application option letters overlap the picoquic options");
+        ret = -1;
+    }
+    else if (picoquic_config_check_option_letters("9:c:") == 0) {
+        DBG_PRINTF("%s", "Did not detect the overlap of option letter c");
+        ret = -1;
+    }
 
     return ret;
 }
@@ -91,6 +100,7 @@ static picoquic_quic_config_t param1 = {
     1,
     UINT64_MAX, /* Do not limit CWIN */
     3, /* Address discovery mode = 3 (cli param -J 2)*/
+    { 0, 0, 0, 16, 4 }, /* tuning */
     /* Common flags */
     1, /* unsigned int initial_random : 1; */
     1, /* unsigned int use_long_log : 1; */
@@ -159,6 +169,8 @@ static char const* config_argv1[] = {
     "-J", "2",
     "-E", "ech_key.pem", "ech_config.pem",
     "-y", "test.example.com",
+    "-4", "16",
+    "-5", "4",
     NULL
 };
 
@@ -187,6 +199,7 @@ static picoquic_quic_config_t param2 = {
     0,
     1000000, /* Limit CWIN to 1 million bytes */
     0, /* Do not enable address discovery */
+    { 0, 0, 0, 0, 0 }, /* tuning */
     /* Common flags */
     3, /* unsigned int initial_random : 1; */
     0, /* unsigned int use_long_log : 1; */
@@ -310,6 +323,9 @@ static config_error_test_t config_errors[] = {
     { 2, { "-U", "XY000002" }},
     { 2, { "-W", "cwin" }},
     { 2, { "-d", "idle" }},
+    { 2, { "-4", "batch" }},
+    { 2, { "-4", "-1" }},
+    { 2, { "-5", "1000" }},
 #ifdef PICOQUIC_WITHOUT_SSLKEYLOG
     { 1, {"-8"}},
 #endif
@@ -431,6 +447,11 @@ int config_test_compare(const picoquic_quic_config_t* expected, const picoquic_q
     ret |= config_test_compare_int("bdp", expected->bdp_frame_option, actual->bdp_frame_option);
     ret |= config_test_compare_int("idle_timeout", expected->idle_timeout, actual->idle_timeout);
     ret |= config_test_compare_uint64("cwin_max", expected->cwin_max, actual->cwin_max);
+    ret |= config_test_compare_uint64("packet_pool", expected->tuning.max_packets_in_pool, actual->tuning.max_packets_in_pool);
+    ret |= config_test_compare_uint64("data_node_pool", expected->tuning.max_data_nodes_in_pool, actual->tuning.max_data_nodes_in_pool);
+    ret |= config_test_compare_uint64("recv_batch", expected->tuning.packet_loop_recv_max, actual->tuning.packet_loop_recv_max);
+    ret |= config_test_compare_uint64("send_batch", expected->tuning.packet_loop_send_max, actual->tuning.packet_loop_send_max);
+    ret |= config_test_compare_int("path_target", expected->tuning.max_simultaneous_paths, actual->tuning.max_simultaneous_paths);
 #ifndef PICOQUIC_WITHOUT_SSLKEYLOG
     ret |= config_test_compare_int("sslkeylog", expected->enable_sslkeylog, actual->enable_sslkeylog);
 #endif
@@ -598,6 +619,67 @@ int config_set_option_test_one()
     return (ret);
 }
 
+static const char* config_long_argv[] = {
+    "picoquicdemo",
+    "--packet_pool", "4096",
+    "-p", "4443",
+    "--data_node_pool", "2048",
+    "--recv_batch", "32",
+    "--no_disk",
+    "test.example.com",
+    NULL
+};
+
+static const char* config_long_errors[][3] = {
+    { "picoquicdemo", "--packet_pool", "pool" },
+    { "picoquicdemo", "--recv_batch", NULL },
+    { "picoquicdemo", "--no_such_option", "1" }
+};
+
+static int config_long_options_test()
+{
+    int ret = 0;
+    char* argv[16];
+    int argc = (int)(sizeof(config_long_argv) / sizeof(char const*)) - 1;
+    picoquic_quic_config_t config;
+
+    for (int i = 0; i <= argc; i++) {
+        argv[i] = (char*)config_long_argv[i];
+    }
+    picoquic_config_init(&config);
+    if (picoquic_config_long_options(&argc, argv, &config) != 0) {
+        DBG_PRINTF("%s", "Could not parse the long options");
+        ret = -1;
+    }
+    else if (argc != 4 || strcmp(argv[1], "-p") != 0 || strcmp(argv[2], "4443") != 0 ||
+        strcmp(argv[3], "test.example.com") != 0 || argv[4] != NULL) {
+        DBG_PRINTF("Unexpected arguments left after long options, argc = %d", argc);
+        ret = -1;
+    }
+    else if (config.tuning.max_packets_in_pool != 4096 || config.tuning.max_data_nodes_in_pool != 2048 ||
+        config.tuning.packet_loop_recv_max != 32 || !config.no_disk) {
+        DBG_PRINTF("%s", "Long options not applied");
+        ret = -1;
+    }
+    picoquic_config_clear(&config);
+
+    for (size_t i = 0; ret == 0 && i < sizeof(config_long_errors) / sizeof(config_long_errors[0]); i++) {
+        argc = (config_long_errors[i][2] == NULL) ? 2 : 3;
+        for (int j = 0; j < 3; j++) {
+            argv[j] = (char*)config_long_errors[i][j];
+        }
+        argv[3] = NULL;
+        picoquic_config_init(&config);
+        if (picoquic_config_long_options(&argc, argv, &config) == 0) {
+            DBG_PRINTF("Did not detect long option error %zu, %s", i, config_long_errors[i][1]);
+            ret = -1;
+        }
+        picoquic_config_clear(&config);
+    }
+
+    return ret;
+}
+
 int config_option_test()
 {
     int ret = config_parse_command_line_test(&param1, config_argv1, (int)(sizeof(config_argv1) / sizeof(char const*)) - 1);
@@ -619,6 +701,10 @@ int config_option_test()
         }
     }
 
+    if (ret == 0) {
+        ret = config_long_options_test();
+    }
+
     for (size_t i = 0; ret == 0 && i < nb_config_errors; i++) {
         picoquic_quic_config_t config = { 0 };
         if (config_parse_command_line(&config, config_errors[i].err_args,
@@ -631,6 +717,44 @@ int config_option_test()
     return ret;
 }
 
+/* Check that at least some parameters are what we expect */
+static int config_quic_check(picoquic_quic_config_t* config, picoquic_quic_t* quic)
+{
+    int ret = 0;
+
+    if (config->nb_connections > 0 && config->nb_connections != quic->max_number_connections) {
+        ret = -1;
+    }
+    if (config->alpn != NULL &&
+        (quic->default_alpn == NULL || strcmp(quic->default_alpn, config->alpn) != 0)) {
+        ret = -1;
+    }
+    if (config->has_reset_seed &&
+        memcmp(quic->reset_seed, config->reset_seed, sizeof(config->reset_seed)) != 0) {
+        ret = -1;
+    }
+    if (config->cc_algo_id != NULL &&
+        (quic->default_congestion_alg == NULL ||
+            strcmp(quic->default_congestion_alg->congestion_algorithm_id, config->cc_algo_id) != 0)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        picoquic_tuning_t tuning;
+
+        picoquic_get_tuning(quic, &tuning);
+        if ((config->tuning.max_packets_in_pool > 0 && tuning.max_packets_in_pool != config->tuning.max_packets_in_pool) ||
+            (config->tuning.max_data_nodes_in_pool > 0 && tuning.max_data_nodes_in_pool != config->tuning.max_data_nodes_in_pool) ||
+            (config->tuning.packet_loop_recv_max > 0 && tuning.packet_loop_recv_max != config->tuning.packet_loop_recv_max) ||
+            (config->tuning.packet_loop_send_max > 0 && tuning.packet_loop_send_max != config->tuning.packet_loop_send_max) ||
+            (config->tuning.max_simultaneous_paths > 0 && tuning.max_simultaneous_paths != config->tuning.max_simultaneous_paths) ||
+            tuning.max_packets_in_pool == 0 || tuning.max_data_nodes_in_pool == 0 ||
+            tuning.packet_loop_recv_max == 0 || tuning.packet_loop_send_max == 0 || tuning.max_simultaneous_paths == 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
 int config_quic_test_one(picoquic_quic_config_t* config)
 {
     int ret = 0;
@@ -698,24 +822,22 @@ int config_quic_test_one(picoquic_quic_config_t* config)
         ret = 1;
     }
     else {
-        /* Check that at least some parameters are what we expect */
-        if (config->nb_connections > 0 && config->nb_connections != quic->max_number_connections) {
-            ret = -1;
-        }
-        if (config->alpn != NULL &&
-            (quic->default_alpn == NULL || strcmp(quic->default_alpn, config->alpn) != 0)) {
-            ret = -1;
-        }
-        if (config->has_reset_seed &&
-            memcmp(quic->reset_seed, config->reset_seed, sizeof(config->reset_seed)) != 0) {
-            ret = -1;
+        ret = config_quic_check(config, quic);
+        picoquic_free(quic);
+    }
+
+    if (ret == 0) {
+        /* Each shard of a group must have the same configuration */
+        picoquic_quic_group_t* group = picoquic_create_and_configure_group(2, config, NULL, NULL, current_time, NULL);
+        if (group == NULL) {
+            ret = 1;
         }
-        if (config->cc_algo_id != NULL &&
-            (quic->default_congestion_alg == NULL ||
-                strcmp(quic->default_congestion_alg->congestion_algorithm_id, config->cc_algo_id) != 0)) {
-            ret = -1;
+        else {
+            for (int i = 0; ret == 0 && i < picoquic_quic_group_size(group); i++) {
+                ret = config_quic_check(config, picoquic_quic_group_shard(group, i));
+            }
+            picoquic_delete_quic_group(group);
         }
-        picoquic_free(quic);
     }
 
     if (server_key_file != NULL) {
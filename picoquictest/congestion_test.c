@@ -29,6 +29,7 @@
 #include "picoquic_binlog.h"
 #include "picoquic_logger.h"
 #include "qlog.h"
+#include "cc_replay.h"
 
 #include "picoquic_newreno.h"
 #include "picoquic_cubic.h"
@@ -36,6 +37,8 @@
 #include "picoquic_bbr1.h"
 #include "picoquic_fastcc.h"
 #include "picoquic_prague.h"
+#include "picoquic_coupled_cc.h"
+#include "cc_common.h"
 
 static test_api_stream_desc_t test_scenario_congestion[] = {
     { 4, 0, 257, 1000000 },
@@ -717,6 +720,717 @@ int bdp_bbr1_test()
     return bdp_option_test_one(bdp_test_option_bbr1);
 }
 
+/*
+ * Careful resume test. The server keeps a cache of path parameters.
+ * A first connection populates the cache when it is deleted. A second
+ * connection from the same client, without session resumption, should
+ * be seeded from the cache and jump to the saved window.
+ */
+int careful_resume_test()
+{
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    uint64_t latency = 100000ull;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_connection_id_t initial_cid = { {0xca, 0x4e, 0, 0, 0, 0, 0, 0}, 8 };
+    int ret = tls_api_init_ctx_ex(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN,
+        &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    if (ret == 0) {
+        test_ctx->c_to_s_link->microsec_latency = latency;
+        test_ctx->s_to_c_link->microsec_latency = latency;
+        test_ctx->c_to_s_link->picosec_per_byte = (1000000ull * 8) / 20;
+        test_ctx->s_to_c_link->picosec_per_byte = (1000000ull * 8) / 20;
+        picoquic_set_default_congestion_algorithm(test_ctx->qserver, picoquic_bbr_algorithm);
+        ret = picoquic_set_careful_resume(test_ctx->qserver, 16, 0);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body(test_ctx, &simulated_time, test_scenario_10mb, sizeof(test_scenario_10mb),
+            0, 0, 0, 2 * latency, 0);
+    }
+
+    /* Delete the server connection, which should save the path parameters */
+    if (ret == 0) {
+        uint8_t* ip_addr;
+        uint8_t ip_addr_length;
+
+        if (test_ctx->cnx_server != NULL) {
+            picoquic_delete_cnx(test_ctx->cnx_server);
+            test_ctx->cnx_server = NULL;
+        }
+        picoquic_get_ip_addr((struct sockaddr*)&test_ctx->client_addr, &ip_addr, &ip_addr_length);
+        if (picoquic_careful_resume_find(test_ctx->qserver, ip_addr, ip_addr_length, simulated_time) == NULL) {
+            DBG_PRINTF("%s", "No careful resume record saved by server.");
+            ret = -1;
+        }
+    }
+
+    /* Create a new client connection, without session resumption */
+    if (ret == 0) {
+        picoquic_delete_cnx(test_ctx->cnx_client);
+        test_api_delete_test_streams(test_ctx);
+        picoquic_free_tickets(&test_ctx->qclient->p_first_ticket);
+
+        test_ctx->cnx_client = picoquic_create_cnx(test_ctx->qclient,
+            picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&test_ctx->server_addr, simulated_time,
+            0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, 1);
+
+        if (test_ctx->cnx_client == NULL) {
+            ret = -1;
+        }
+        else {
+            ret = picoquic_start_client_cnx(test_ctx->cnx_client);
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_10mb, sizeof(test_scenario_10mb));
+    }
+
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &loss_mask, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_verify(test_ctx, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        if (test_ctx->cnx_server == NULL || !test_ctx->cnx_server->cwin_notified_from_seed) {
+            DBG_PRINTF("%s", "Server cwin not seeded from careful resume.");
+            ret = -1;
+        }
+        else if (test_ctx->qserver->careful_resume->nb_jumps == 0) {
+            DBG_PRINTF("%s", "No careful resume jump.");
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+/*
+ * Congestion control snapshot test. For each algorithm, run a transfer,
+ * export the state of the server path, and import it in the client path,
+ * which uses the same algorithm. Verify that the path values are restored,
+ * that truncated snapshots are rejected without changing the state, and
+ * that snapshots cannot be imported in a path using another algorithm.
+ */
+static test_api_stream_desc_t test_scenario_cc_snapshot[] = {
+    { 4, 0, 257, 1000000 }
+};
+
+static int cc_snapshot_test_one(picoquic_congestion_algorithm_t* ccalgo, picoquic_congestion_algorithm_t* other_algo)
+{
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_connection_id_t initial_cid = { {0xcc, 0x54, 0, 0, 0, 0, 0, 0}, 8 };
+    uint8_t snapshot[PICOQUIC_CC_SNAPSHOT_MAX];
+    size_t snapshot_length = 0;
+    int ret;
+
+    initial_cid.id[2] = ccalgo->congestion_algorithm_number;
+    ret = tls_api_init_ctx_ex(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN,
+        &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    if (ret == 0) {
+        test_ctx->c_to_s_link->microsec_latency = 25000;
+        test_ctx->s_to_c_link->microsec_latency = 25000;
+        test_ctx->c_to_s_link->picosec_per_byte = (1000000ull * 8) / 20;
+        test_ctx->s_to_c_link->picosec_per_byte = (1000000ull * 8) / 20;
+        picoquic_set_default_congestion_algorithm(test_ctx->qserver, ccalgo);
+        picoquic_set_congestion_algorithm(test_ctx->cnx_client, ccalgo);
+
+        ret = tls_api_one_scenario_body(test_ctx, &simulated_time, test_scenario_cc_snapshot,
+            sizeof(test_scenario_cc_snapshot), 0, 0, 0, 0, 0);
+    }
+
+    if (ret == 0 && test_ctx->cnx_server == NULL) {
+        DBG_PRINTF("%s: no server connection.\n", ccalgo->congestion_algorithm_id);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        if (picoquic_export_path_cc_state(test_ctx->cnx_server, 0, snapshot, 4, &snapshot_length, simulated_time) == 0) {
+            DBG_PRINTF("%s: export in short buffer should fail.\n", ccalgo->congestion_algorithm_id);
+            ret = -1;
+        }
+        else if ((ret = picoquic_export_path_cc_state(test_ctx->cnx_server, 0, snapshot, sizeof(snapshot),
+            &snapshot_length, simulated_time)) != 0) {
+            DBG_PRINTF("%s: export fails, ret = 0x%x.\n", ccalgo->congestion_algorithm_id, ret);
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_path_t* client_path = test_ctx->cnx_client->path[0];
+        picoquic_path_t* server_path = test_ctx->cnx_server->path[0];
+        uint64_t client_cwin = client_path->cwin;
+
+        if (picoquic_import_path_cc_state(test_ctx->cnx_client, 0, snapshot, snapshot_length - 1, simulated_time) == 0) {
+            DBG_PRINTF("%s: import of truncated snapshot should fail.\n", ccalgo->congestion_algorithm_id);
+            ret = -1;
+        }
+        else if (client_path->cwin != client_cwin) {
+            DBG_PRINTF("%s: failed import changed cwin.\n", ccalgo->congestion_algorithm_id);
+            ret = -1;
+        }
+        else if ((ret = picoquic_import_path_cc_state(test_ctx->cnx_client, 0, snapshot, snapshot_length, simulated_time)) != 0) {
+            DBG_PRINTF("%s: import fails, ret = 0x%x.\n", ccalgo->congestion_algorithm_id, ret);
+        }
+        else if (client_path->cwin != server_path->cwin ||
+            client_path->rtt_min != server_path->rtt_min ||
+            client_path->smoothed_rtt != server_path->smoothed_rtt ||
+            client_path->is_ssthresh_initialized != server_path->is_ssthresh_initialized) {
+            DBG_PRINTF("%s: path values not restored, cwin %" PRIu64 " vs %" PRIu64 ", rtt_min %" PRIu64 " vs %" PRIu64 ".\n",
+                ccalgo->congestion_algorithm_id, client_path->cwin, server_path->cwin,
+                client_path->rtt_min, server_path->rtt_min);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_set_congestion_algorithm(test_ctx->cnx_client, other_algo);
+        if (picoquic_import_path_cc_state(test_ctx->cnx_client, 0, snapshot, snapshot_length, simulated_time) !=
+            PICOQUIC_ERROR_CC_SNAPSHOT_MISMATCH) {
+            DBG_PRINTF("%s: import with algorithm %s should fail.\n", ccalgo->congestion_algorithm_id,
+                other_algo->congestion_algorithm_id);
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+int cc_snapshot_test()
+{
+    picoquic_congestion_algorithm_t* algos[] = {
+        picoquic_newreno_algorithm,
+        picoquic_cubic_algorithm,
+        picoquic_bbr_algorithm,
+        picoquic_bbr1_algorithm,
+        picoquic_prague_algorithm,
+        picoquic_fastcc_algorithm,
+        picoquic_lia_algorithm,
+        picoquic_balia_algorithm
+    };
+    size_t nb_algos = sizeof(algos) / sizeof(picoquic_congestion_algorithm_t*);
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < nb_algos; i++) {
+        ret = cc_snapshot_test_one(algos[i], algos[(i + 1) % nb_algos]);
+    }
+
+    return ret;
+}
+
+/*
+ * Check the fixed point helpers used in the per-ACK computations of BBR and
+ * Cubic. Applying a Q16 gain must match the floating point product within
+ * the precision of the Q16 representation, and the integer cube root must
+ * be exact, i.e., r^3 <= x < (r+1)^3.
+ */
+int cc_fixed_point_test()
+{
+    const double gains[] = { 0.5, 0.9, 1.0, 1.125, 1.25, 2.0, 2.25, 2.77 };
+    const uint64_t values[] = { 0, 1, 1199, 1440, 15360, 1000000, 123456789, 0x10000000011ull, 0xFFFFFFFFFFFFull };
+    const uint64_t roots[] = { 0, 1, 2, 7, 8, 9, 26, 27, 28, 1000, 1000000, 1000000000000ull,
+        0x7FFFFFFFFFFFFFFFull, 0x8000000000000000ull, UINT64_MAX };
+    const double windows[] = { 0.5, 1.0, 2.0, 10.0, 83.3, 1000.0, 12345.6, 65535.0 };
+    uint64_t x = 0x123456789abcdefull;
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < sizeof(gains) / sizeof(double); i++) {
+        uint64_t gain_q16 = PICOQUIC_CC_Q16(gains[i]);
+        for (size_t j = 0; ret == 0 && j < sizeof(values) / sizeof(uint64_t); j++) {
+            uint64_t fixed = picoquic_cc_apply_gain_q16(values[j], gain_q16);
+            uint64_t reference = (uint64_t)(gains[i] * (double)values[j]);
+            uint64_t delta = (fixed > reference) ? fixed - reference : reference - fixed;
+            if (delta > 1 + reference / 10000) {
+                DBG_PRINTF("Gain %f, value %" PRIu64 ": fixed %" PRIu64 " vs %" PRIu64 "\n",
+                    gains[i], values[j], fixed, reference);
+                ret = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < sizeof(roots) / sizeof(uint64_t) + 256; i++) {
+        uint64_t v;
+        uint64_t r;
+        if (i < sizeof(roots) / sizeof(uint64_t)) {
+            v = roots[i];
+        }
+        else {
+            x = x * 6364136223846793005ull + 1442695040888963407ull;
+            v = x >> (i % 64);
+        }
+        r = picoquic_cc_cube_root(v);
+        /* 2642245 is the largest integer whose cube fits in 64 bits */
+        if (r * r * r > v || (r < 2642245 && (r + 1) * (r + 1) * (r + 1) <= v)) {
+            DBG_PRINTF("Cube root of %" PRIu64 " returns %" PRIu64 "\n", v, r);
+            ret = -1;
+        }
+    }
+
+    /* The cubic K coefficient is computed from a Q48 argument, giving a Q16 root */
+    for (size_t i = 0; ret == 0 && i < sizeof(windows) / sizeof(double); i++) {
+        double k = (double)picoquic_cc_cube_root((uint64_t)(windows[i] * (double)(1ull << 48))) / 65536.0;
+        double k3 = k * k * k;
+        if (k3 > windows[i] * 1.0001 || k3 < windows[i] * 0.9999) {
+            DBG_PRINTF("Cube root of %f returns %f\n", windows[i], k);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Check the congestion control telemetry ring: take a handle on the server path,
+ * run a transfer long enough to wrap the ring, verify that the reader gets the
+ * latest samples in order, and that the handle survives the connection.
+ */
+#define CC_TELEMETRY_TEST_SAMPLES 64
+
+int cc_telemetry_test()
+{
+    uint64_t simulated_time = 0;
+    uint64_t latency = 10000ull;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_cc_telemetry_t* telemetry = NULL;
+    picoquic_cc_sample_t samples[2 * CC_TELEMETRY_TEST_SAMPLES];
+    uint64_t next_sequence = 0;
+    size_t nb_read = 0;
+    picoquic_connection_id_t initial_cid = { {0xcc, 0x7e, 0, 0, 0, 0, 0, 0}, 8 };
+    int ret = tls_api_init_ctx_ex(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN,
+        &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    if (ret == 0) {
+        test_ctx->c_to_s_link->microsec_latency = latency;
+        test_ctx->s_to_c_link->microsec_latency = latency;
+        picoquic_set_default_congestion_algorithm(test_ctx->qserver, picoquic_bbr_algorithm);
+        picoquic_set_default_cc_telemetry(test_ctx->qserver, CC_TELEMETRY_TEST_SAMPLES, 1000);
+        ret = tls_api_one_scenario_body_connect(test_ctx, &simulated_time, 0, 0, 0);
+    }
+
+    if (ret == 0) {
+        if (test_ctx->cnx_server == NULL ||
+            (telemetry = picoquic_get_cc_telemetry(test_ctx->cnx_server, 0)) == NULL) {
+            DBG_PRINTF("%s", "No telemetry ring on server path.");
+            ret = -1;
+        }
+        else if (picoquic_get_cc_telemetry(test_ctx->cnx_client, 0) != NULL) {
+            DBG_PRINTF("%s", "Unexpected telemetry ring on client path.");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_10mb, sizeof(test_scenario_10mb));
+    }
+
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &test_ctx->loss_mask_default, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_verify(test_ctx, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        nb_read = picoquic_read_cc_telemetry(telemetry, &next_sequence, samples, 2 * CC_TELEMETRY_TEST_SAMPLES);
+        if (nb_read == 0 || nb_read > CC_TELEMETRY_TEST_SAMPLES || next_sequence <= CC_TELEMETRY_TEST_SAMPLES) {
+            DBG_PRINTF("Read %zu samples, next sequence %" PRIu64, nb_read, next_sequence);
+            ret = -1;
+        }
+        else if (samples[nb_read - 1].sequence + 1 != next_sequence ||
+            samples[0].sequence + CC_TELEMETRY_TEST_SAMPLES < next_sequence) {
+            DBG_PRINTF("Unexpected sequences %" PRIu64 " to %" PRIu64 ", next %" PRIu64,
+                samples[0].sequence, samples[nb_read - 1].sequence, next_sequence);
+            ret = -1;
+        }
+        for (size_t i = 0; ret == 0 && i < nb_read; i++) {
+            if (samples[i].cwin == 0 || samples[i].smoothed_rtt == 0 ||
+                (i > 0 && (samples[i].sequence <= samples[i - 1].sequence ||
+                    samples[i].sample_time < samples[i - 1].sample_time + 1000))) {
+                DBG_PRINTF("Unexpected sample %zu, sequence %" PRIu64, i, samples[i].sequence);
+                ret = -1;
+            }
+        }
+        /* Nothing new to read */
+        if (ret == 0 && picoquic_read_cc_telemetry(telemetry, &next_sequence, samples, 2 * CC_TELEMETRY_TEST_SAMPLES) != 0) {
+            DBG_PRINTF("%s", "Samples read twice.");
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    /* The handle remains readable after the path is deleted */
+    if (telemetry != NULL) {
+        if (ret == 0 && !picoquic_cc_telemetry_is_closed(telemetry)) {
+            DBG_PRINTF("%s", "Telemetry not closed after path deletion.");
+            ret = -1;
+        }
+        else if (ret == 0) {
+            next_sequence = 0;
+            if (picoquic_read_cc_telemetry(telemetry, &next_sequence, samples, 2 * CC_TELEMETRY_TEST_SAMPLES) == 0) {
+                DBG_PRINTF("%s", "Cannot read telemetry after path deletion.");
+                ret = -1;
+            }
+        }
+        picoquic_release_cc_telemetry(telemetry);
+    }
+
+    return ret;
+}
+
+/*
+ * Check the connection statistics snapshots: take a handle on the server
+ * connection, run a transfer, verify that the published statistics follow
+ * the connection, and that the handle survives the connection.
+ */
+int cnx_stats_test()
+{
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_cnx_stats_block_t* block = NULL;
+    picoquic_cnx_stats_t stats;
+    uint64_t last_sequence = 0;
+    picoquic_connection_id_t initial_cid = { {0xc5, 0x7a, 0, 0, 0, 0, 0, 0}, 8 };
+    int ret = tls_api_init_ctx_ex(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN,
+        &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    memset(&stats, 0, sizeof(stats));
+
+    if (ret == 0) {
+        picoquic_set_default_cnx_stats_interval(test_ctx->qserver, 1000);
+        ret = tls_api_one_scenario_body_connect(test_ctx, &simulated_time, 0, 0, 0);
+    }
+
+    if (ret == 0) {
+        if (test_ctx->cnx_server == NULL || (block = picoquic_get_cnx_stats(test_ctx->cnx_server)) == NULL) {
+            DBG_PRINTF("%s", "No statistics block on server connection.");
+            ret = -1;
+        }
+        else if (picoquic_get_cnx_stats(test_ctx->cnx_client) != NULL) {
+            DBG_PRINTF("%s", "Unexpected statistics block on client connection.");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_very_long, sizeof(test_scenario_very_long));
+    }
+
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &test_ctx->loss_mask_default, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        if (picoquic_read_cnx_stats(block, &stats) != 0) {
+            DBG_PRINTF("%s", "Cannot read the connection statistics.");
+            ret = -1;
+        }
+        else if (stats.sequence < 2 || stats.publish_time > simulated_time ||
+            stats.cnx_state != (uint64_t)picoquic_state_ready || stats.nb_paths != 1 ||
+            stats.data_sent == 0 || stats.data_sent > test_ctx->cnx_server->data_sent ||
+            stats.nb_packets_sent == 0 || stats.nb_packets_received == 0 ||
+            stats.default_path.cwin == 0 || stats.default_path.rtt == 0) {
+            DBG_PRINTF("Unexpected statistics, sequence %" PRIu64 ", state %" PRIu64 ", sent %" PRIu64,
+                stats.sequence, stats.cnx_state, stats.data_sent);
+            ret = -1;
+        }
+        else {
+            last_sequence = stats.sequence;
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_verify(test_ctx, &simulated_time, 0);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    /* The last statistics are published when the connection is deleted */
+    if (block != NULL) {
+        if (ret == 0 && !picoquic_cnx_stats_is_closed(block)) {
+            DBG_PRINTF("%s", "Statistics not closed after connection deletion.");
+            ret = -1;
+        }
+        else if (ret == 0 && (picoquic_read_cnx_stats(block, &stats) != 0 || stats.sequence <= last_sequence)) {
+            DBG_PRINTF("%s", "No final statistics after connection deletion.");
+            ret = -1;
+        }
+        picoquic_release_cnx_stats(block);
+    }
+
+    return ret;
+}
+
+/*
+ * HyStart++ test. First, drive the shared component with synthetic rounds:
+ * an RTT increase moves to CSS, a decrease below the CSS baseline resumes
+ * slow start, and a confirmed increase ends slow start after CSS_ROUNDS
+ * rounds. Then, run a transfer with each algorithm using HyStart++, and
+ * check that the telemetry reports the exit from slow start.
+ */
+static void cc_hystart_pp_round(picoquic_hystart_pp_t* hspp, picoquic_cnx_t* cnx, uint64_t rtt, int* nb_exits)
+{
+    picoquic_packet_context_t* pkt_ctx = &cnx->pkt_ctx[picoquic_packet_context_application];
+
+    /* Acknowledge the end of the previous round, then send the next one */
+    pkt_ctx->highest_acknowledged = pkt_ctx->send_sequence;
+    pkt_ctx->send_sequence += 2 * PICOQUIC_HYSTART_PP_N_RTT_SAMPLE;
+    for (int i = 0; i < PICOQUIC_HYSTART_PP_N_RTT_SAMPLE; i++) {
+        *nb_exits += picoquic_hystart_pp_test(hspp, cnx, cnx->path[0], rtt + i);
+        if (i == 0) {
+            /* The next samples belong to the same round */
+            pkt_ctx->highest_acknowledged = pkt_ctx->send_sequence - 1;
+        }
+    }
+}
+
+static int cc_hystart_pp_unit_test()
+{
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_hystart_pp_t hspp;
+    int nb_exits = 0;
+    int ret = tls_api_init_ctx(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 0, 0);
+
+    if (ret == 0) {
+        picoquic_set_hystart_pp(test_ctx->qclient, 1);
+        test_ctx->cnx_client->pkt_ctx[picoquic_packet_context_application].send_sequence = 100;
+        picoquic_hystart_pp_reset(&hspp, test_ctx->cnx_client, test_ctx->cnx_client->path[0]);
+        if (!hspp.is_enabled || hspp.phase != picoquic_hystart_pp_slow_start) {
+            DBG_PRINTF("%s", "HyStart++ not enabled after reset.");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Two rounds at 20 ms, then 25 ms: the threshold is 4 ms, enter CSS */
+        cc_hystart_pp_round(&hspp, test_ctx->cnx_client, 20000, &nb_exits);
+        cc_hystart_pp_round(&hspp, test_ctx->cnx_client, 20000, &nb_exits);
+        if (hspp.phase != picoquic_hystart_pp_slow_start) {
+            DBG_PRINTF("%s", "Left slow start at constant RTT.");
+            ret = -1;
+        }
+        else {
+            cc_hystart_pp_round(&hspp, test_ctx->cnx_client, 25000, &nb_exits);
+            if (hspp.phase != picoquic_hystart_pp_css || hspp.css_baseline_min_rtt != 25000) {
+                DBG_PRINTF("Phase %d, baseline %" PRIu64 " after RTT increase.", hspp.phase, hspp.css_baseline_min_rtt);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* A round below the baseline means the increase was spurious */
+        cc_hystart_pp_round(&hspp, test_ctx->cnx_client, 21000, &nb_exits);
+        if (hspp.phase != picoquic_hystart_pp_slow_start) {
+            DBG_PRINTF("Phase %d after spurious increase.", hspp.phase);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* A new increase is confirmed at the end of the CSS rounds */
+        cc_hystart_pp_round(&hspp, test_ctx->cnx_client, 30000, &nb_exits);
+        for (int i = 0; ret == 0 && i < PICOQUIC_HYSTART_PP_CSS_ROUNDS; i++) {
+            if (hspp.phase != picoquic_hystart_pp_css || nb_exits != 0) {
+                DBG_PRINTF("Phase %d, %d exits at CSS round %d.", hspp.phase, nb_exits, i);
+                ret = -1;
+            }
+            else {
+                cc_hystart_pp_round(&hspp, test_ctx->cnx_client, 30000, &nb_exits);
+            }
+        }
+        if (ret == 0 && (hspp.phase != picoquic_hystart_pp_done || nb_exits != 1)) {
+            DBG_PRINTF("Phase %d, %d exits after CSS rounds.", hspp.phase, nb_exits);
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+    }
+
+    return ret;
+}
+
+static int cc_hystart_pp_test_one(picoquic_congestion_algorithm_t* ccalgo)
+{
+    uint64_t simulated_time = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_cc_telemetry_t* telemetry = NULL;
+    picoquic_cc_sample_t samples[CC_TELEMETRY_TEST_SAMPLES];
+    uint64_t next_sequence = 0;
+    size_t nb_read = 0;
+    picoquic_connection_id_t initial_cid = { {0xcc, 0x55, 0, 0, 0, 0, 0, 0}, 8 };
+    int ret;
+
+    initial_cid.id[2] = ccalgo->congestion_algorithm_number;
+    ret = tls_api_init_ctx_ex(&test_ctx, 0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN,
+        &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    if (ret == 0) {
+        test_ctx->c_to_s_link->microsec_latency = 25000;
+        test_ctx->s_to_c_link->microsec_latency = 25000;
+        test_ctx->c_to_s_link->picosec_per_byte = (1000000ull * 8) / 20;
+        test_ctx->s_to_c_link->picosec_per_byte = (1000000ull * 8) / 20;
+        picoquic_set_default_congestion_algorithm(test_ctx->qserver, ccalgo);
+        picoquic_set_hystart_pp(test_ctx->qserver, 1);
+        picoquic_set_default_cc_telemetry(test_ctx->qserver, CC_TELEMETRY_TEST_SAMPLES, 0);
+        ret = tls_api_one_scenario_body_connect(test_ctx, &simulated_time, 0, 0, 0);
+    }
+
+    if (ret == 0 && (test_ctx->cnx_server == NULL ||
+        (telemetry = picoquic_get_cc_telemetry(test_ctx->cnx_server, 0)) == NULL)) {
+        DBG_PRINTF("%s: no telemetry ring on server path.", ccalgo->congestion_algorithm_id);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = test_api_init_send_recv_scenario(test_ctx, test_scenario_10mb, sizeof(test_scenario_10mb));
+    }
+
+    if (ret == 0) {
+        ret = tls_api_data_sending_loop(test_ctx, &test_ctx->loss_mask_default, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_one_scenario_body_verify(test_ctx, &simulated_time, 0);
+    }
+
+    if (ret == 0) {
+        nb_read = picoquic_read_cc_telemetry(telemetry, &next_sequence, samples, CC_TELEMETRY_TEST_SAMPLES);
+        if (nb_read == 0) {
+            DBG_PRINTF("%s: no telemetry samples.", ccalgo->congestion_algorithm_id);
+            ret = -1;
+        }
+        else if (samples[nb_read - 1].slow_start_exit_reason == picoquic_slow_start_exit_none ||
+            samples[nb_read - 1].slow_start_exit_reason == picoquic_slow_start_exit_rtt ||
+            samples[nb_read - 1].slow_start_exit_time == 0) {
+            DBG_PRINTF("%s: slow start exit reason %" PRIu64 " at %" PRIu64, ccalgo->congestion_algorithm_id,
+                samples[nb_read - 1].slow_start_exit_reason, samples[nb_read - 1].slow_start_exit_time);
+            ret = -1;
+        }
+    }
+
+    if (telemetry != NULL) {
+        picoquic_release_cc_telemetry(telemetry);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+int cc_hystart_pp_test()
+{
+    picoquic_congestion_algorithm_t* algos[] = {
+        picoquic_newreno_algorithm,
+        picoquic_cubic_algorithm,
+        picoquic_prague_algorithm
+    };
+    int ret = cc_hystart_pp_unit_test();
+
+    for (size_t i = 0; ret == 0 && i < sizeof(algos) / sizeof(picoquic_congestion_algorithm_t*); i++) {
+        ret = cc_hystart_pp_test_one(algos[i]);
+    }
+
+    return ret;
+}
+
+/*
+ * Check the offline replay of congestion control: record the binary log of a
+ * transfer, then replay the ACK and loss events through the same and through
+ * a different algorithm.
+ */
+#define CC_REPLAY_TRACE_BIN "cc4e9a0102030405.server.log"
+#define CC_REPLAY_TRACE_CSV "cc_replay_trace.csv"
+
+int cc_replay_test()
+{
+    uint64_t simulated_time = 0;
+    uint64_t latency = 20000;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_connection_id_t initial_cid = { {0xcc, 0x4e, 0x9a, 1, 2, 3, 4, 5}, 8 };
+    picoquic_congestion_algorithm_t* algos[] = { picoquic_newreno_algorithm, picoquic_bbr_algorithm };
+    int ret = 0;
+
+    (void)picoquic_file_delete(CC_REPLAY_TRACE_BIN, NULL);
+
+    ret = tls_api_init_ctx_ex(&test_ctx, PICOQUIC_INTERNAL_TEST_VERSION_1, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN,
+        &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    if (ret == 0) {
+        picoquic_set_default_congestion_algorithm(test_ctx->qserver, picoquic_newreno_algorithm);
+        picoquic_set_binlog(test_ctx->qserver, ".");
+        test_ctx->qserver->use_long_log = 1;
+        test_ctx->c_to_s_link->microsec_latency = latency;
+        test_ctx->s_to_c_link->microsec_latency = latency;
+        test_ctx->s_to_c_link->picosec_per_byte = (1000000ull * 8) / 10;
+
+        ret = tls_api_one_scenario_body(test_ctx, &simulated_time,
+            test_scenario_very_long, sizeof(test_scenario_very_long), 0, 0, 0, 2 * latency, 0);
+    }
+
+    /* Free the resource, which will close the log file. */
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    for (size_t i = 0; ret == 0 && i < sizeof(algos) / sizeof(picoquic_congestion_algorithm_t*); i++) {
+        picoquic_cc_replay_stats_t stats;
+
+        memset(&stats, 0, sizeof(stats));
+        ret = picoquic_cc_replay_file(CC_REPLAY_TRACE_BIN, &initial_cid, algos[i], NULL, CC_REPLAY_TRACE_CSV, &stats);
+        if (ret != 0) {
+            DBG_PRINTF("Replay of %s with %s returns %d", CC_REPLAY_TRACE_BIN, algos[i]->congestion_algorithm_id, ret);
+        }
+        else if (stats.nb_packets_sent == 0 || stats.nb_acks == 0 || stats.bytes_acked < 1000000 ||
+            stats.nb_rows != stats.nb_acks + stats.nb_losses) {
+            DBG_PRINTF("Replay with %s: %" PRIu64 " sent, %" PRIu64 " acks, %" PRIu64 " bytes acked",
+                algos[i]->congestion_algorithm_id, stats.nb_packets_sent, stats.nb_acks, stats.bytes_acked);
+            ret = -1;
+        }
+        else if (stats.cwin_max <= PICOQUIC_CWIN_INITIAL) {
+            DBG_PRINTF("Replay with %s: cwin never grew, max %" PRIu64, algos[i]->congestion_algorithm_id, stats.cwin_max);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
 /*
  * The "blackhole" test simulates a link breakage of 2 seconds, during which all packets
  * are lost. The connection is expected to survive the blackhole, and then recover.
@@ -38,9 +38,116 @@
 #include "picoquic_binlog.h"
 #include "picoquic_config.h"
 #include "tls_api.h"
+#include "picoquic_cpp.h"
+#include <vector>
+#include <array>
 
 extern "C" {
     int cplusplustest() {
         return 0;
     }
 }
+
+/* Test of the C++ layer in picoquic_cpp.h.
+ * Checks the span conversions and the buffer moves, then hands a buffer
+ * to the zero copy API of a client connection, and verifies that the
+ * trampoline delivers the callbacks to the handler object.
+ */
+namespace {
+    struct cplusplus_test_handler {
+        int nb_events;
+        size_t nb_bytes;
+        uint64_t last_stream_id;
+
+        int operator()(picoquic::connection_ref cnx, uint64_t stream_id, picoquic::mutable_byte_span bytes,
+            picoquic_call_back_event_t event, void* stream_ctx)
+        {
+            (void)stream_ctx;
+            if (cnx && event == picoquic_callback_stream_data) {
+                nb_events++;
+                nb_bytes += bytes.size();
+                last_stream_id = stream_id;
+            }
+            return 0;
+        }
+    };
+}
+
+extern "C" {
+    int cplusplus_wrapper_test() {
+        int ret = 0;
+        uint64_t simulated_time = 0;
+        std::vector<uint8_t> vec(100, 0x5a);
+        const std::array<uint8_t, 8> arr = { { 1, 2, 3, 4, 5, 6, 7, 8 } };
+        picoquic::byte_span from_vec(vec);
+        picoquic::byte_span from_arr(arr);
+        picoquic::mutable_byte_span writable(vec);
+        picoquic::byte_span from_writable = writable;
+        picoquic::buffer b1(1000);
+        picoquic::buffer b2;
+        cplusplus_test_handler handler = { 0, 0, 0 };
+
+        if (from_vec.size() != 100 || from_vec.data() != vec.data() || from_arr.size() != 8 || from_arr[7] != 8 ||
+            from_writable.data() != vec.data() || from_arr.subspan(6).size() != 2 || from_arr.subspan(10, 4).size() != 0 ||
+            from_vec.subspan(10, 20).data() != vec.data() + 10) {
+            DBG_PRINTF("%s", "Unexpected span values");
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            memset(b1.data(), 0x33, b1.size());
+            b2 = std::move(b1);
+            if (b1.size() != 0 || b1.data() != NULL || b2.size() != 1000) {
+                DBG_PRINTF("%s", "Buffer move failed");
+                ret = -1;
+            }
+        }
+
+        if (ret == 0) {
+            picoquic::quic qclient(picoquic_create(8, NULL, NULL, NULL, PICOQUIC_TEST_ALPN, NULL, NULL, NULL, NULL, NULL,
+                simulated_time, &simulated_time, NULL, NULL, 0));
+            struct sockaddr_in server_addr;
+
+            memset(&server_addr, 0, sizeof(server_addr));
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_port = htons(4443);
+            server_addr.sin_addr.s_addr = htonl(0x0a000001);
+
+            if (!qclient) {
+                ret = -1;
+            }
+            else {
+                picoquic::connection cnx = qclient.create_client_connection((struct sockaddr*)&server_addr, simulated_time,
+                    0, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &handler);
+                picoquic::buffer copied = picoquic::buffer::copy_of(from_arr);
+
+                if (!cnx || copied.size() != arr.size() || memcmp(copied.data(), arr.data(), arr.size()) != 0) {
+                    ret = -1;
+                }
+                else if (cnx.add_to_stream(0, from_vec, false) != 0 ||
+                    cnx.add_to_stream_zero_copy(0, std::move(b2), false) != 0 ||
+                    cnx.add_to_stream_zero_copy(4, std::move(copied), true) != 0) {
+                    DBG_PRINTF("%s", "Cannot queue stream data");
+                    ret = -1;
+                }
+                else if (b2.data() != NULL || copied.data() != NULL) {
+                    DBG_PRINTF("%s", "Ownership of the buffers was not transferred");
+                    ret = -1;
+                }
+                else {
+                    /* Simulate a call from the stack */
+                    picoquic_cnx_t* c = cnx.get();
+                    ret = c->callback_fn(c, 4, vec.data(), vec.size(), picoquic_callback_stream_data, c->callback_ctx, NULL);
+                    if (ret == 0 && (handler.nb_events != 1 || handler.nb_bytes != vec.size() || handler.last_stream_id != 4)) {
+                        DBG_PRINTF("%s", "Handler was not called through the trampoline");
+                        ret = -1;
+                    }
+                }
+                /* The connection is deleted before the QUIC context, which
+                 * releases the buffers queued without copy. */
+            }
+        }
+
+        return ret;
+    }
+}
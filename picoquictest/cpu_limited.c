@@ -78,6 +78,7 @@ typedef struct st_limited_test_config_t {
     uint64_t picosec_per_byte;
     uint64_t flow_control_max;
     uint64_t nb_losses_max;
+    size_t receive_batch_max;
 } limited_test_config_t;
 
 int limited_client_create_scenario(
@@ -148,6 +149,7 @@ int limited_client_test_one(limited_test_config_t * config)
         test_ctx->client_endpoint.incoming_cpu_time = config->incoming_cpu_time;
         test_ctx->client_endpoint.prepare_cpu_time = config->prepare_cpu_time;
         test_ctx->client_endpoint.packet_queue_max = config->packet_queue_max;
+        test_ctx->client_endpoint.receive_batch_max = config->receive_batch_max;
         test_ctx->qserver->use_long_log = 1;
         picoquic_set_binlog(test_ctx->qserver, ".");
         test_ctx->qclient->use_long_log = 1;
@@ -166,6 +168,11 @@ int limited_client_test_one(limited_test_config_t * config)
             scenario, scenario_size, 0, 0, 0, 4 * config->microsec_latency, config->max_completion_time);
     }
 
+    if (ret == 0 && config->receive_batch_max > 1 && test_ctx->client_endpoint.nb_batched_packets == 0) {
+        DBG_PRINTF("%s", "No packets were received in batches");
+        ret = -1;
+    }
+
     if (ret == 0 && config->nb_losses_max != 0) {
         if (test_ctx->cnx_server == NULL) {
             DBG_PRINTF("Cannot verify number of losses < %" PRIu64 ", server connection deleted",
@@ -249,6 +256,19 @@ int limited_batch_test()
     return limited_client_test_one(&config);
 }
 
+/* The client submits the packets waiting in its queue with
+ * picoquic_incoming_packets, paying the processing time once per batch */
+int limited_recv_batch_test()
+{
+    limited_test_config_t config;
+    limited_config_set_default(&config, 6);
+    config.ccalgo = picoquic_bbr_algorithm;
+    config.max_completion_time = 4100000;
+    config.receive_batch_max = 8;
+
+    return limited_client_test_one(&config);
+}
+
 int limited_safe_test()
 {
     limited_test_config_t config;
@@ -638,4 +638,143 @@ int datagram_small_packet_test()
     dg_ctx.duration_max = 2060000;
 
     return datagram_test_one(9, &dg_ctx, 0);
-}
\ No newline at end of file
+}
+/*
+ * Test the datagram send ring. The client queues datagrams of different
+ * priorities, some of which expire before they can be sent, and overflows
+ * the ring. The server shall receive the datagrams that were neither
+ * expired nor dropped, in priority order.
+ */
+#define DATAGRAM_RING_TEST_SLOTS 8
+#define DATAGRAM_RING_TEST_LENGTH 100
+
+typedef struct st_datagram_ring_test_ctx_t {
+    uint8_t priority_received[DATAGRAM_RING_TEST_SLOTS + 1];
+    int nb_received;
+} datagram_ring_test_ctx_t;
+
+static int datagram_ring_test_recv(picoquic_cnx_t* cnx, uint64_t unique_path_id,
+    uint8_t* bytes, size_t length, void* datagram_ctx)
+{
+    int ret = 0;
+    datagram_ring_test_ctx_t* ring_ctx = (datagram_ring_test_ctx_t*)datagram_ctx;
+    (void)unique_path_id;
+
+    if (cnx->client_mode || length != DATAGRAM_RING_TEST_LENGTH ||
+        ring_ctx->nb_received >= DATAGRAM_RING_TEST_SLOTS + 1) {
+        ret = -1;
+    }
+    else {
+        ring_ctx->priority_received[ring_ctx->nb_received++] = bytes[0];
+    }
+    return ret;
+}
+
+static int datagram_ring_test_ack(picoquic_cnx_t* cnx,
+    picoquic_call_back_event_t d_event, uint8_t* bytes, size_t length, uint64_t sent_time, void* datagram_ctx)
+{
+    (void)cnx;
+    (void)d_event;
+    (void)bytes;
+    (void)length;
+    (void)sent_time;
+    (void)datagram_ctx;
+    return 0;
+}
+
+int datagram_ring_test()
+{
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_connection_id_t initial_cid = { {0xda, 0xda, 0x02, 0, 0, 0, 0, 0}, 8 };
+    picoquic_tp_t client_parameters;
+    datagram_ring_test_ctx_t ring_ctx;
+    /* Priorities of the queued datagrams, 0 marks a datagram that expires before sending */
+    const uint8_t queued[DATAGRAM_RING_TEST_SLOTS] = { 2, 8, 0, 2, 8, 2, 0, 2 };
+    const uint8_t expected[6] = { 1, 2, 2, 2, 2, 8 };
+    uint8_t datagram[DATAGRAM_RING_TEST_LENGTH];
+    size_t nb_queued = 0;
+    uint64_t nb_expired = 0;
+    uint64_t nb_dropped = 0;
+    int ret;
+
+    memset(&ring_ctx, 0, sizeof(ring_ctx));
+    memset(datagram, 0, sizeof(datagram));
+
+    ret = tls_api_init_ctx_ex(&test_ctx, PICOQUIC_INTERNAL_TEST_VERSION_1,
+        PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, &simulated_time, NULL, NULL, 0, 1, 0,
+        &initial_cid);
+
+    if (ret == 0) {
+        test_ctx->datagram_ctx = &ring_ctx;
+        test_ctx->datagram_recv_fn = datagram_ring_test_recv;
+        test_ctx->datagram_ack_fn = datagram_ring_test_ack;
+        picoquic_init_transport_parameters(&client_parameters, 1);
+        client_parameters.max_datagram_frame_size = PICOQUIC_MAX_PACKET_SIZE;
+        picoquic_set_transport_parameters(test_ctx->cnx_client, &client_parameters);
+        ret = picoquic_start_client_cnx(test_ctx->cnx_client);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0 && picoquic_queue_datagram_to_ring(test_ctx->cnx_client, datagram, sizeof(datagram), 1, 0) !=
+        PICOQUIC_ERROR_UNEXPECTED_STATE) {
+        DBG_PRINTF("%s", "Datagram queued without a ring\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = picoquic_set_datagram_send_ring(test_ctx->cnx_client, DATAGRAM_RING_TEST_SLOTS, 256);
+    }
+
+    for (int i = 0; ret == 0 && i < DATAGRAM_RING_TEST_SLOTS; i++) {
+        datagram[0] = queued[i];
+        ret = picoquic_queue_datagram_to_ring(test_ctx->cnx_client, datagram, sizeof(datagram),
+            (queued[i] == 0) ? 4 : queued[i], (queued[i] == 0) ? simulated_time : 0);
+    }
+
+    if (ret == 0) {
+        /* The ring is full. A higher priority datagram replaces the most recent
+         * of the lowest priority ones, a lower priority one is refused. */
+        datagram[0] = 1;
+        ret = picoquic_queue_datagram_to_ring(test_ctx->cnx_client, datagram, sizeof(datagram), 1, 0);
+        if (ret == 0) {
+            datagram[0] = 9;
+            if (picoquic_queue_datagram_to_ring(test_ctx->cnx_client, datagram, sizeof(datagram), 9, 0) !=
+                PICOQUIC_ERROR_DATAGRAM_QUEUE_FULL) {
+                DBG_PRINTF("%s", "Datagram queued in full ring\n");
+                ret = -1;
+            }
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < 1000 && ring_ctx.nb_received < 6; i++) {
+        int was_active = 0;
+
+        ret = tls_api_one_sim_round(test_ctx, &simulated_time, 0, &was_active);
+    }
+
+    if (ret == 0) {
+        picoquic_get_datagram_ring_stats(test_ctx->cnx_client, &nb_queued, &nb_expired, &nb_dropped);
+        if (ring_ctx.nb_received != 6 || memcmp(ring_ctx.priority_received, expected, sizeof(expected)) != 0 ||
+            nb_queued != 0 || nb_expired != 2 || nb_dropped != 1) {
+            DBG_PRINTF("Datagram ring: received %d, queued %" PRIst ", expired %" PRIu64 ", dropped %" PRIu64 "\n",
+                ring_ctx.nb_received, nb_queued, nb_expired, nb_dropped);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = picoquic_set_datagram_send_ring(test_ctx->cnx_client, 0, 0);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
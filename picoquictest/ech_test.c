@@ -198,8 +198,60 @@ int ech_cert_test()
 typedef struct st_ech_e2e_spec_t {
     int expect_success;
     int expect_grease;
+    int check_config_cache;
 } ech_e2e_spec_t;
 
+/* Verify the client cache of ECH configurations. The client receives a list
+ * in which an unsupported configuration precedes the server configuration,
+ * and shall only pass the server configuration to the TLS stack. A second
+ * connection with the same list shall find the configuration in the cache.
+ */
+static int ech_test_check_config_cache(picoquic_test_tls_api_ctx_t* test_ctx, ptls_buffer_t* ech_config_buf)
+{
+    int ret = 0;
+    uint8_t unknown_config[8] = { 0xfe, 0x0a, 0, 4, 1, 2, 3, 4 };
+    size_t list_len = sizeof(unknown_config) + ech_config_buf->off;
+    uint8_t* list = (uint8_t*)malloc(list_len);
+    picoquic_tls_ctx_t* tls_ctx = (picoquic_tls_ctx_t*)test_ctx->cnx_client->tls_ctx;
+
+    if (list == NULL) {
+        ret = -1;
+    }
+    else {
+        picoformat_16(list, (uint16_t)(list_len - 2));
+        memcpy(list + 2, unknown_config, sizeof(unknown_config));
+        memcpy(list + 2 + sizeof(unknown_config), ech_config_buf->base + 2, ech_config_buf->off - 2);
+
+        if ((ret = picoquic_ech_configure_client(test_ctx->cnx_client, list, list_len)) == 0 &&
+            (tls_ctx->handshake_properties.client.ech.configs.len != ech_config_buf->off ||
+                memcmp(tls_ctx->handshake_properties.client.ech.configs.base, ech_config_buf->base, ech_config_buf->off) != 0)) {
+            DBG_PRINTF("%s", "The server configuration was not selected");
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            picoquic_cnx_t* cnx2 = picoquic_create_cnx(test_ctx->qclient, picoquic_null_connection_id,
+                picoquic_null_connection_id, (struct sockaddr*)&test_ctx->server_addr, 0,
+                PICOQUIC_INTERNAL_TEST_VERSION_1, PICOQUIC_TEST_SNI, PICOQUIC_TEST_ALPN, 1);
+
+            if (cnx2 == NULL) {
+                ret = -1;
+            }
+            else {
+                if (picoquic_ech_configure_client(cnx2, list, list_len) != 0 ||
+                    picoquic_ech_get_client_cache_hits(test_ctx->qclient) != 1) {
+                    DBG_PRINTF("%s", "The ECH configuration was not found in the cache");
+                    ret = -1;
+                }
+                picoquic_delete_cnx(cnx2);
+            }
+        }
+        free(list);
+    }
+
+    return ret;
+}
+
 int ech_test_check_retry_config(picoquic_cnx_t* cnx,
     uint8_t* config, size_t config_len)
 {
@@ -274,7 +326,10 @@ int ech_e2e_test_one(ech_e2e_spec_t * spec)
     }
 
     if (ret == 0) {
-        if (spec->expect_success) {
+        if (spec->check_config_cache) {
+            ret = ech_test_check_config_cache(test_ctx, &ech_config_buf);
+        }
+        else if (spec->expect_success) {
             picoquic_ech_configure_client(test_ctx->cnx_client, ech_config_buf.base, ech_config_buf.off);
         }
         else {
@@ -336,4 +391,12 @@ int ech_grease_test()
     ech_e2e_spec_t spec = { 0 };
     spec.expect_grease = 1;
     return ech_e2e_test_one(&spec);
-}
\ No newline at end of file
+}
+
+int ech_config_cache_test()
+{
+    ech_e2e_spec_t spec = { 0 };
+    spec.expect_success = 1;
+    spec.check_config_cache = 1;
+    return ech_e2e_test_one(&spec);
+}
@@ -32,6 +32,7 @@
 #include "picoquic_bbr1.h"
 #include "picoquic_fastcc.h"
 #include "picoquic_prague.h"
+#include "picoquic_coupled_cc.h"
 
 /* Verify that the getter/setter functions work as expected 
  */
@@ -117,7 +118,7 @@ int getter_test()
                 ret = -1;
             }
             else {
-                picoquic_delete_misc_or_dg(&cnx->first_misc_frame, &cnx->last_misc_frame, cnx->last_misc_frame);
+                picoquic_delete_misc_or_dg(cnx, &cnx->first_misc_frame, &cnx->last_misc_frame, cnx->last_misc_frame);
                 if (cnx->first_misc_frame == NULL || cnx->first_misc_frame->next_misc_frame != NULL) {
                     ret = -1;
                 }
@@ -241,12 +242,13 @@ int getter_test()
     picoquic_register_all_congestion_control_algorithms();
     if (ret == 0) {
         char const* alg_name[] = {
-            "reno", "cubic", "dcubic", "fast", "bbr", "prague", "bbr1", "wuovipfwds", NULL
+            "reno", "cubic", "dcubic", "fast", "bbr", "prague", "bbr1", "lia", "olia", "balia", "wuovipfwds", NULL
         };
         picoquic_congestion_algorithm_t const* alg[] = {
             picoquic_newreno_algorithm, picoquic_cubic_algorithm, picoquic_dcubic_algorithm,
             picoquic_fastcc_algorithm, picoquic_bbr_algorithm, picoquic_prague_algorithm,
-            picoquic_bbr1_algorithm, NULL, NULL
+            picoquic_bbr1_algorithm, picoquic_lia_algorithm, picoquic_olia_algorithm,
+            picoquic_balia_algorithm, NULL, NULL
         };
         size_t nb_alg = sizeof(alg_name) / sizeof(char const*);
 
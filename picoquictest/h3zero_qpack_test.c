@@ -0,0 +1,434 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "h3zero.h"
+#include "h3zero_qpack.h"
+
+/* Tests of the QPACK dynamic table. The header frames are produced with
+ * the static table, rewritten by the encoder, and parsed by the decoder
+ * after the encoder instructions are passed to the decoder, and the decoder
+ * instructions back to the encoder.
+ */
+
+#define QPACK_TEST_PATH "/index.html"
+#define QPACK_TEST_HOST "www.example.com"
+
+static int qpack_test_init(h3zero_qpack_encoder_t* encoder, h3zero_qpack_decoder_t* decoder,
+    uint64_t capacity, uint64_t blocked_streams)
+{
+    int ret = h3zero_qpack_decoder_init(decoder, capacity, blocked_streams);
+
+    if (ret == 0) {
+        ret = h3zero_qpack_encoder_init(encoder, capacity, capacity, blocked_streams);
+    }
+    if (ret != 0) {
+        DBG_PRINTF("Cannot init QPACK with capacity %" PRIu64, capacity);
+    }
+    return ret;
+}
+
+static int qpack_test_encoder_to_decoder(h3zero_qpack_encoder_t* encoder, h3zero_qpack_decoder_t* decoder)
+{
+    int ret = 0;
+
+    if (encoder->instructions.length > 0) {
+        uint64_t error_found = h3zero_qpack_decoder_receive(decoder, encoder->instructions.bytes, encoder->instructions.length);
+        if (error_found != 0) {
+            DBG_PRINTF("Decoder error 0x%" PRIx64, error_found);
+            ret = -1;
+        }
+        encoder->instructions.length = 0;
+    }
+    return ret;
+}
+
+static int qpack_test_decoder_to_encoder(h3zero_qpack_encoder_t* encoder, h3zero_qpack_decoder_t* decoder)
+{
+    int ret = 0;
+
+    if (decoder->instructions.length > 0) {
+        /* Feed the instructions one byte at a time, to test the buffering of partial instructions */
+        for (size_t i = 0; ret == 0 && i < decoder->instructions.length; i++) {
+            uint64_t error_found = h3zero_qpack_encoder_receive(encoder, decoder->instructions.bytes + i, 1);
+            if (error_found != 0) {
+                DBG_PRINTF("Encoder error 0x%" PRIx64, error_found);
+                ret = -1;
+            }
+        }
+        decoder->instructions.length = 0;
+    }
+    return ret;
+}
+
+static void qpack_test_release(h3zero_qpack_encoder_t* encoder, h3zero_qpack_decoder_t* decoder)
+{
+    h3zero_qpack_encoder_release(encoder);
+    h3zero_qpack_decoder_release(decoder);
+}
+
+static void qpack_test_release_parts(h3zero_header_parts_t* parts)
+{
+    if (parts->path != NULL) {
+        free((uint8_t*)parts->path);
+    }
+    if (parts->range != NULL) {
+        free((uint8_t*)parts->range);
+    }
+    if (parts->protocol != NULL) {
+        free((uint8_t*)parts->protocol);
+    }
+    memset(parts, 0, sizeof(h3zero_header_parts_t));
+}
+
+/* Encode a request header, then parse it, optionally after passing the
+ * encoder instructions to the decoder. Returns the length of the section
+ * before and after encoding with the dynamic table. */
+static int qpack_test_request(h3zero_qpack_encoder_t* encoder, h3zero_qpack_decoder_t* decoder,
+    uint64_t stream_id, char const* host, int deliver_first, size_t* static_length, size_t* encoded_length, int* is_blocked)
+{
+    int ret = 0;
+    uint8_t section[256];
+    uint8_t encoded[256];
+    uint8_t* section_last = h3zero_create_request_header_frame(section, section + sizeof(section),
+        (uint8_t const*)QPACK_TEST_PATH, strlen(QPACK_TEST_PATH), host);
+    uint8_t* encoded_last = h3zero_qpack_encode_section(encoder, stream_id, section, section_last,
+        encoded, encoded + sizeof(encoded));
+
+    *is_blocked = 0;
+    if (section_last == NULL || encoded_last == NULL) {
+        DBG_PRINTF("Cannot encode request on stream %" PRIu64, stream_id);
+        ret = -1;
+    }
+    else if (deliver_first && qpack_test_encoder_to_decoder(encoder, decoder) != 0) {
+        ret = -1;
+    }
+    else {
+        h3zero_header_parts_t parts;
+        uint64_t required_insert_count = 0;
+        uint8_t* parsed = h3zero_parse_qpack_header_frame_ex(encoded, encoded_last, &parts,
+            decoder, stream_id, &required_insert_count, is_blocked);
+
+        *static_length = section_last - section;
+        *encoded_length = encoded_last - encoded;
+        if (*is_blocked) {
+            if (parsed != NULL || required_insert_count <= decoder->table.insert_count) {
+                DBG_PRINTF("Unexpected blocked state, RIC %" PRIu64, required_insert_count);
+                ret = -1;
+            }
+        }
+        else if (parsed != encoded_last) {
+            DBG_PRINTF("Cannot parse request on stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+        else if (parts.method != h3zero_method_get || parts.path == NULL ||
+            parts.path_length != strlen(QPACK_TEST_PATH) || memcmp(parts.path, QPACK_TEST_PATH, parts.path_length) != 0) {
+            DBG_PRINTF("Wrong request parts on stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+        qpack_test_release_parts(&parts);
+    }
+
+    return ret;
+}
+
+/* Basic scenario: the first request inserts the authority and user agent
+ * in the table, the following requests refer to them. */
+int h3zero_qpack_dynamic_test()
+{
+    h3zero_qpack_encoder_t encoder;
+    h3zero_qpack_decoder_t decoder;
+    int ret = qpack_test_init(&encoder, &decoder, H3ZERO_QPACK_DEFAULT_TABLE_CAPACITY, H3ZERO_QPACK_DEFAULT_BLOCKED_STREAMS);
+
+    for (uint64_t stream_id = 0; ret == 0 && stream_id < 40; stream_id += 4) {
+        size_t static_length = 0;
+        size_t encoded_length = 0;
+        int is_blocked = 0;
+
+        ret = qpack_test_request(&encoder, &decoder, stream_id, QPACK_TEST_HOST, 1, &static_length, &encoded_length, &is_blocked);
+        if (ret == 0 && is_blocked) {
+            DBG_PRINTF("Stream %" PRIu64 " is blocked", stream_id);
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = qpack_test_decoder_to_encoder(&encoder, &decoder);
+        }
+        if (ret == 0 && encoded_length + 16 > static_length) {
+            /* The authority and user agent are replaced by one byte references */
+            DBG_PRINTF("Section %zu bytes, static %zu bytes", encoded_length, static_length);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (encoder.table.insert_count != 2 || decoder.table.insert_count != 2 ||
+        encoder.first_section != NULL || encoder.known_received_count != 2)) {
+        DBG_PRINTF("Unexpected table state, %" PRIu64 " entries, KRC %" PRIu64,
+            decoder.table.insert_count, encoder.known_received_count);
+        ret = -1;
+    }
+
+    qpack_test_release(&encoder, &decoder);
+
+    return ret;
+}
+
+/* The section is parsed before the encoder instructions arrive, and
+ * is blocked. Parsing succeeds once the instructions are received. */
+int h3zero_qpack_blocked_test()
+{
+    h3zero_qpack_encoder_t encoder;
+    h3zero_qpack_decoder_t decoder;
+    int ret = qpack_test_init(&encoder, &decoder, H3ZERO_QPACK_DEFAULT_TABLE_CAPACITY, 1);
+    uint8_t section[256];
+    uint8_t encoded[256];
+    uint8_t* section_last = h3zero_create_request_header_frame(section, section + sizeof(section),
+        (uint8_t const*)QPACK_TEST_PATH, strlen(QPACK_TEST_PATH), QPACK_TEST_HOST);
+    uint8_t* encoded_last = NULL;
+
+    if (ret == 0) {
+        /* Pass the set capacity instruction */
+        ret = qpack_test_encoder_to_decoder(&encoder, &decoder);
+    }
+
+    if (ret == 0) {
+        encoded_last = h3zero_qpack_encode_section(&encoder, 0, section, section_last, encoded, encoded + sizeof(encoded));
+        if (encoded_last == NULL || !h3zero_qpack_encoder_is_blocking(&encoder, 0) ||
+            h3zero_qpack_encoder_nb_blocking_streams(&encoder) != 1) {
+            DBG_PRINTF("%s", "Section should be blocking");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Only one blocked stream is allowed, so a second stream does not reference new entries */
+        size_t static_length = 0;
+        size_t encoded_length = 0;
+        int is_blocked = 0;
+
+        ret = qpack_test_request(&encoder, &decoder, 4, "other.example.com", 0, &static_length, &encoded_length, &is_blocked);
+        if (ret == 0 && (is_blocked || h3zero_qpack_encoder_nb_blocking_streams(&encoder) != 1)) {
+            DBG_PRINTF("%s", "Second stream should not block");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        h3zero_header_parts_t parts;
+        uint64_t required_insert_count = 0;
+        int is_blocked = 0;
+
+        if (h3zero_parse_qpack_header_frame_ex(encoded, encoded_last, &parts, &decoder, 0,
+            &required_insert_count, &is_blocked) != NULL || !is_blocked) {
+            DBG_PRINTF("%s", "Section should be blocked");
+            ret = -1;
+        }
+        qpack_test_release_parts(&parts);
+
+        if (ret == 0) {
+            ret = qpack_test_encoder_to_decoder(&encoder, &decoder);
+        }
+        if (ret == 0) {
+            if (h3zero_parse_qpack_header_frame_ex(encoded, encoded_last, &parts, &decoder, 0,
+                &required_insert_count, &is_blocked) != encoded_last || is_blocked ||
+                parts.method != h3zero_method_get) {
+                DBG_PRINTF("%s", "Section should be decoded");
+                ret = -1;
+            }
+            qpack_test_release_parts(&parts);
+        }
+        if (ret == 0) {
+            ret = qpack_test_decoder_to_encoder(&encoder, &decoder);
+        }
+        if (ret == 0 && (h3zero_qpack_encoder_nb_blocking_streams(&encoder) != 0 || encoder.first_section != NULL)) {
+            DBG_PRINTF("%s", "Section not acknowledged");
+            ret = -1;
+        }
+    }
+
+    qpack_test_release(&encoder, &decoder);
+
+    return ret;
+}
+
+/* If the peer does not allow blocked streams, new entries are only
+ * referenced after the peer acknowledged them. */
+int h3zero_qpack_no_block_test()
+{
+    h3zero_qpack_encoder_t encoder;
+    h3zero_qpack_decoder_t decoder;
+    int ret = qpack_test_init(&encoder, &decoder, H3ZERO_QPACK_DEFAULT_TABLE_CAPACITY, 0);
+
+    for (uint64_t stream_id = 0; ret == 0 && stream_id < 8; stream_id += 4) {
+        size_t static_length = 0;
+        size_t encoded_length = 0;
+        int is_blocked = 0;
+
+        /* Parse the section before the instructions are received */
+        ret = qpack_test_request(&encoder, &decoder, stream_id, QPACK_TEST_HOST, 0, &static_length, &encoded_length, &is_blocked);
+        if (ret == 0 && (is_blocked || h3zero_qpack_encoder_is_blocking(&encoder, stream_id))) {
+            DBG_PRINTF("Stream %" PRIu64 " is blocked", stream_id);
+            ret = -1;
+        }
+        if (ret == 0 && (stream_id == 0) != (encoder.first_section == NULL)) {
+            DBG_PRINTF("Unexpected section references, stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = qpack_test_encoder_to_decoder(&encoder, &decoder);
+        }
+        if (ret == 0) {
+            ret = qpack_test_decoder_to_encoder(&encoder, &decoder);
+        }
+    }
+
+    qpack_test_release(&encoder, &decoder);
+
+    return ret;
+}
+
+/* With a small table, entries are evicted as new hosts are inserted,
+ * but never while referenced by unacknowledged sections. */
+int h3zero_qpack_eviction_test()
+{
+    h3zero_qpack_encoder_t encoder;
+    h3zero_qpack_decoder_t decoder;
+    int ret = qpack_test_init(&encoder, &decoder, 128, H3ZERO_QPACK_DEFAULT_BLOCKED_STREAMS);
+
+    for (uint64_t stream_id = 0; ret == 0 && stream_id < 64; stream_id += 4) {
+        char host[64];
+        size_t static_length = 0;
+        size_t encoded_length = 0;
+        int is_blocked = 0;
+
+        (void)picoquic_sprintf(host, sizeof(host), NULL, "host%d.example.com", (int)(stream_id / 4));
+        ret = qpack_test_request(&encoder, &decoder, stream_id, host, 1, &static_length, &encoded_length, &is_blocked);
+        if (ret == 0 && is_blocked) {
+            ret = -1;
+        }
+        if (ret == 0 && (stream_id & 4) == 0) {
+            /* Only acknowledge every other stream */
+            ret = qpack_test_decoder_to_encoder(&encoder, &decoder);
+        }
+        if (ret == 0 && (encoder.table.size > encoder.table.capacity || decoder.table.size > encoder.table.capacity)) {
+            DBG_PRINTF("Table size %" PRIu64 " above capacity", encoder.table.size);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (encoder.table.dropped_count == 0 || decoder.table.dropped_count != encoder.table.dropped_count)) {
+        DBG_PRINTF("Unexpected evictions, encoder %" PRIu64 ", decoder %" PRIu64,
+            encoder.table.dropped_count, decoder.table.dropped_count);
+        ret = -1;
+    }
+
+    qpack_test_release(&encoder, &decoder);
+
+    return ret;
+}
+
+/* Invalid instructions and sections are rejected */
+int h3zero_qpack_error_test()
+{
+    h3zero_qpack_encoder_t encoder;
+    h3zero_qpack_decoder_t decoder;
+    uint8_t capacity_too_large[] = { 0x3F, 0xE2, 0x1F }; /* Set capacity 4097 */
+    uint8_t bad_duplicate[] = { 0x05 }; /* Duplicate entry 5 */
+    uint8_t bad_static[] = { 0xFF, 0x40, 0x01, 'x' }; /* Insert with static name 127 */
+    uint8_t bad_ack[] = { 0x88 }; /* Section acknowledgement for stream 8 */
+    uint8_t bad_increment[] = { 0x00 }; /* Increment 0 */
+    uint8_t bad_section[] = { 0x02, 0x00, 0x80 }; /* RIC 1, relative index 0 */
+    int ret = 0;
+    struct {
+        uint8_t* bytes;
+        size_t length;
+        int is_decoder;
+        uint64_t expected;
+    } cases[] = {
+        { capacity_too_large, sizeof(capacity_too_large), 1, H3ZERO_QPACK_ENCODER_STREAM_ERROR },
+        { bad_duplicate, sizeof(bad_duplicate), 1, H3ZERO_QPACK_ENCODER_STREAM_ERROR },
+        { bad_static, sizeof(bad_static), 1, H3ZERO_QPACK_ENCODER_STREAM_ERROR },
+        { bad_ack, sizeof(bad_ack), 0, H3ZERO_QPACK_DECODER_STREAM_ERROR },
+        { bad_increment, sizeof(bad_increment), 0, H3ZERO_QPACK_DECODER_STREAM_ERROR }
+    };
+
+    for (size_t i = 0; ret == 0 && i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint64_t error_found;
+
+        ret = qpack_test_init(&encoder, &decoder, H3ZERO_QPACK_DEFAULT_TABLE_CAPACITY, 0);
+        if (ret == 0) {
+            error_found = (cases[i].is_decoder) ?
+                h3zero_qpack_decoder_receive(&decoder, cases[i].bytes, cases[i].length) :
+                h3zero_qpack_encoder_receive(&encoder, cases[i].bytes, cases[i].length);
+            if (error_found != cases[i].expected) {
+                DBG_PRINTF("Case %zu, error 0x%" PRIx64 " instead of 0x%" PRIx64, i, error_found, cases[i].expected);
+                ret = -1;
+            }
+        }
+        qpack_test_release(&encoder, &decoder);
+    }
+
+    if (ret == 0) {
+        h3zero_header_parts_t parts;
+        uint64_t required_insert_count = 0;
+        int is_blocked = 0;
+
+        /* Without a decoder, references to the dynamic table are an error */
+        if (h3zero_parse_qpack_header_frame(bad_section, bad_section + sizeof(bad_section), &parts) != NULL) {
+            DBG_PRINTF("%s", "Section with dynamic references accepted without a table");
+            ret = -1;
+        }
+        qpack_test_release_parts(&parts);
+
+        /* The entry referenced by the section is not in the table */
+        if (ret == 0 && qpack_test_init(&encoder, &decoder, H3ZERO_QPACK_DEFAULT_TABLE_CAPACITY, 0) == 0) {
+            /* Set capacity 4096, then insert with static name :authority */
+            uint8_t insert[] = { 0x3F, 0xE1, 0x1F, 0xC0 | 0x00, 0x01, 'a' };
+
+            if (h3zero_qpack_decoder_receive(&decoder, insert, sizeof(insert)) != 0) {
+                ret = -1;
+            }
+            else {
+                uint8_t post_base[] = { 0x02, 0x00, 0x10 }; /* RIC 1, base 1, post base index 0 */
+
+                if (h3zero_parse_qpack_header_frame_ex(post_base, post_base + sizeof(post_base), &parts, &decoder, 0,
+                    &required_insert_count, &is_blocked) != NULL || is_blocked) {
+                    DBG_PRINTF("%s", "Post base reference beyond the insert count accepted");
+                    ret = -1;
+                }
+                qpack_test_release_parts(&parts);
+            }
+            if (ret == 0 && h3zero_parse_qpack_header_frame_ex(bad_section, bad_section + sizeof(bad_section), &parts, &decoder, 0,
+                &required_insert_count, &is_blocked) != bad_section + sizeof(bad_section)) {
+                DBG_PRINTF("%s", "Valid reference rejected");
+                ret = -1;
+            }
+            qpack_test_release_parts(&parts);
+        }
+        qpack_test_release(&encoder, &decoder);
+    }
+
+    return ret;
+}
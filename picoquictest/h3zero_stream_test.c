@@ -474,6 +474,263 @@ int h3zero_setting_error_test()
     return ret;
 }
 
+/* Test of RFC 9218 priorities:
+* - parsing of priority field values,
+* - parsing of the "priority" header in a request header frame,
+* - encoding and decoding of PRIORITY_UPDATE frames,
+* - reception of PRIORITY_UPDATE on the control stream, and its effect
+*   on the priority of the stream.
+*/
+typedef struct st_h3zero_priority_field_test_t {
+    char const* value;
+    int expected_ret;
+    uint8_t urgency;
+    int is_incremental;
+} h3zero_priority_field_test_t;
+
+static const h3zero_priority_field_test_t h3zero_priority_field_cases[] = {
+    { "", 0, 3, 0 },
+    { "u=1", 0, 1, 0 },
+    { "i", 0, 3, 1 },
+    { "u=5, i", 0, 5, 1 },
+    { "i, u=0", 0, 0, 1 },
+    { "u=2,i=?0", 0, 2, 0 },
+    { "u=7, i=?1", 0, 7, 1 },
+    { "u=9", 0, 3, 0 },
+    { "u=-1", 0, 3, 0 },
+    { "u=1.5", 0, 3, 0 },
+    { "u=4;foo=bar, i", 0, 4, 1 },
+    { "x=\"a, b\", u=6", 0, 6, 0 },
+    { "unknown=(1 2), u=2", 0, 2, 0 },
+    { "u=1,", -1, 3, 0 },
+    { "U=1", -1, 3, 0 },
+    { "u=1 i", -1, 3, 0 },
+    { "x=\"unterminated, u=1", -1, 3, 0 }
+};
+
+static size_t nb_h3zero_priority_field_cases = sizeof(h3zero_priority_field_cases) / sizeof(h3zero_priority_field_test_t);
+
+static int h3zero_priority_field_test()
+{
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < nb_h3zero_priority_field_cases; i++) {
+        uint8_t urgency = H3ZERO_PRIORITY_URGENCY_DEFAULT;
+        int is_incremental = 0;
+        const h3zero_priority_field_test_t* t = &h3zero_priority_field_cases[i];
+        int r = h3zero_parse_priority_field((const uint8_t*)t->value, strlen(t->value), &urgency, &is_incremental);
+
+        if (r != t->expected_ret || urgency != t->urgency || is_incremental != t->is_incremental) {
+            DBG_PRINTF("Priority field <%s>, ret %d, u=%d, i=%d", t->value, r, urgency, is_incremental);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (h3zero_priority_to_stream_priority(H3ZERO_PRIORITY_URGENCY_DEFAULT, 0) != PICOQUIC_DEFAULT_STREAM_PRIORITY ||
+        h3zero_priority_to_stream_priority(0, 1) != 2 ||
+        h3zero_priority_to_stream_priority(7, 0) != 17)) {
+        DBG_PRINTF("%s", "Unexpected mapping of priorities to stream priorities");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int h3zero_priority_header_test()
+{
+    int ret = 0;
+    uint8_t buffer[256];
+    uint8_t* bytes_max = buffer + sizeof(buffer);
+    uint8_t* bytes;
+    char const* path = "/index.html";
+    char const* priority = "u=1, i";
+    h3zero_header_parts_t parts;
+
+    /* Request header, without priority */
+    bytes = h3zero_create_request_header_frame(buffer, bytes_max, (const uint8_t*)path, strlen(path), "example.com");
+    if (bytes == NULL || h3zero_parse_qpack_header_frame(buffer, bytes, &parts) != bytes) {
+        ret = -1;
+    }
+    else {
+        if (parts.has_priority || parts.urgency != H3ZERO_PRIORITY_URGENCY_DEFAULT || parts.is_incremental) {
+            ret = -1;
+        }
+        h3zero_release_header_parts(&parts);
+    }
+
+    /* Add a literal "priority" header without name reference */
+    if (ret == 0) {
+        *bytes = 0x20;
+        if ((bytes = h3zero_qpack_int_encode(bytes, bytes_max, 0x07, 8)) == NULL ||
+            bytes + 8 + 1 + strlen(priority) > bytes_max) {
+            ret = -1;
+        }
+        else {
+            memcpy(bytes, "priority", 8);
+            bytes += 8;
+            *bytes = 0;
+            bytes = h3zero_qpack_int_encode(bytes, bytes_max, 0x7F, strlen(priority));
+            memcpy(bytes, priority, strlen(priority));
+            bytes += strlen(priority);
+            if (h3zero_parse_qpack_header_frame(buffer, bytes, &parts) != bytes) {
+                ret = -1;
+            }
+            else {
+                if (!parts.has_priority || parts.urgency != 1 || !parts.is_incremental ||
+                    parts.method != h3zero_method_get) {
+                    ret = -1;
+                }
+                h3zero_release_header_parts(&parts);
+            }
+        }
+    }
+
+    if (ret != 0) {
+        DBG_PRINTF("%s", "Priority header test fails");
+    }
+
+    return ret;
+}
+
+static int h3zero_priority_update_frame_test()
+{
+    int ret = 0;
+    uint8_t buffer[64];
+    uint8_t* bytes;
+    uint64_t frame_type = 0;
+    uint64_t frame_length = 0;
+    uint64_t stream_id = 0;
+    uint8_t urgency = 0;
+    int is_incremental = 0;
+    const uint8_t* payload;
+
+    if ((bytes = h3zero_create_priority_update_frame(buffer, buffer + sizeof(buffer), 1234, 6, 1)) == NULL ||
+        (payload = picoquic_frames_varint_decode(buffer, bytes, &frame_type)) == NULL ||
+        (payload = picoquic_frames_varint_decode(payload, bytes, &frame_length)) == NULL ||
+        frame_type != h3zero_frame_priority_update_request ||
+        payload + frame_length != bytes ||
+        h3zero_parse_priority_update_frame(payload, bytes, &stream_id, &urgency, &is_incremental) != 0 ||
+        stream_id != 1234 || urgency != 6 || !is_incremental) {
+        ret = -1;
+    }
+    else if (h3zero_create_priority_update_frame(buffer, buffer + 8, 1234, 6, 1) != NULL) {
+        /* Buffer too short */
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        DBG_PRINTF("%s", "Priority update frame test fails");
+    }
+
+    return ret;
+}
+
+/* Submit a PRIORITY_UPDATE frame on a control stream of a simulated server */
+static int h3zero_priority_update_submit(int is_server, uint64_t target_id, uint8_t urgency, int is_incremental, uint64_t expected_error)
+{
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    h3zero_callback_ctx_t* h3_ctx = NULL;
+    uint64_t simulated_time = 0;
+    int ret = h3zero_set_test_context(&quic, &cnx, &h3_ctx, &simulated_time);
+    uint8_t buffer[256];
+    uint8_t* bytes = NULL;
+    uint8_t* last_byte = NULL;
+    uint8_t* bytes_max = buffer + sizeof(buffer);
+    uint64_t error_found = 0;
+    h3zero_stream_ctx_t* control_ctx = NULL;
+    h3zero_stream_ctx_t* request_ctx = NULL;
+
+    /* The request stream is created while the connection is in client mode,
+     * so that the picoquic stream exists before the simulated server
+     * receives the priority update. */
+    if (ret != 0 ||
+        (control_ctx = h3zero_find_or_create_stream(cnx, 3, h3_ctx, 1, 1)) == NULL ||
+        (request_ctx = h3zero_find_or_create_stream(cnx, 0, h3_ctx, 1, 1)) == NULL ||
+        picoquic_set_stream_priority(cnx, 0, PICOQUIC_DEFAULT_STREAM_PRIORITY) != 0 ||
+        (bytes = picoquic_frames_varint_encode(buffer, bytes_max, h3zero_stream_type_control)) == NULL ||
+        (bytes = h3zero_test_get_setting_frame(bytes, bytes_max)) == NULL ||
+        (bytes = h3zero_create_priority_update_frame(bytes, bytes_max, target_id, urgency, is_incremental)) == NULL) {
+        ret = -1;
+    }
+    else {
+        if (is_server) {
+            cnx->client_mode = 0;
+        }
+        last_byte = bytes;
+        bytes = h3zero_test_submit_frame(buffer, last_byte, control_ctx, h3_ctx, &error_found);
+        cnx->client_mode = 1;
+
+        if (expected_error != 0) {
+            if (bytes != NULL || error_found != expected_error) {
+                ret = -1;
+            }
+        }
+        else if (bytes == NULL || error_found != 0) {
+            ret = -1;
+        }
+        else if (target_id == 0) {
+            picoquic_stream_head_t* stream = picoquic_find_stream(cnx, 0);
+
+            if (!request_ctx->ps.stream_state.is_priority_updated ||
+                request_ctx->ps.stream_state.urgency != urgency ||
+                request_ctx->ps.stream_state.is_incremental != is_incremental ||
+                stream == NULL ||
+                stream->stream_priority != h3zero_priority_to_stream_priority(urgency, is_incremental)) {
+                ret = -1;
+            }
+        }
+        else if (request_ctx->ps.stream_state.is_priority_updated) {
+            /* Update for an unknown stream should be ignored */
+            ret = -1;
+        }
+    }
+
+    if (ret != 0) {
+        DBG_PRINTF("Priority update submit fails, server: %d, target: %" PRIu64 ", error: 0x%" PRIx64,
+            is_server, target_id, error_found);
+    }
+
+    /* clean up everything */
+    picoquic_set_callback(cnx, NULL, NULL);
+    h3zero_callback_delete_context(cnx, h3_ctx);
+    picoquic_test_delete_minimal_cnx(&quic, &cnx);
+
+    return ret;
+}
+
+int h3zero_priority_test()
+{
+    int ret = h3zero_priority_field_test();
+
+    if (ret == 0) {
+        ret = h3zero_priority_header_test();
+    }
+    if (ret == 0) {
+        ret = h3zero_priority_update_frame_test();
+    }
+    if (ret == 0) {
+        ret = h3zero_priority_update_submit(1, 0, 1, 1, 0);
+    }
+    if (ret == 0) {
+        ret = h3zero_priority_update_submit(1, 0, 6, 0, 0);
+    }
+    if (ret == 0) {
+        /* Stream not known yet, update is ignored */
+        ret = h3zero_priority_update_submit(1, 8, 1, 1, 0);
+    }
+    if (ret == 0) {
+        /* Unidir stream cannot be prioritized */
+        ret = h3zero_priority_update_submit(1, 2, 1, 1, H3ZERO_ID_ERROR);
+    }
+    if (ret == 0) {
+        /* Clients do not accept PRIORITY_UPDATE */
+        ret = h3zero_priority_update_submit(0, 0, 1, 1, H3ZERO_FRAME_UNEXPECTED);
+    }
+
+    return ret;
+}
+
 /* Unit test of data callback.
 * 
 * we want to exercise `h3zero_callback_data` without actually setting up connections.
@@ -955,4 +1212,104 @@ int h3zero_capsule_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
+/* Parse a sequence of capsules: datagram capsules that arrive in one
+ * piece are delivered from the input, split or non datagram capsules are
+ * reassembled in the fixed buffer of the context, and larger capsules use
+ * a heap buffer.
+ */
+int h3zero_capsule_parse_test()
+{
+    int ret = 0;
+    const size_t large_length = H3ZERO_CAPSULE_BUFFER_SIZE + 100;
+    const size_t close_length = 12;
+    size_t stream_length = 0;
+    uint8_t* stream_bytes = (uint8_t*)malloc(3 * sizeof(capsule_datagram) + close_length + large_length + 32);
+    h3zero_capsule_t* capsule = (h3zero_capsule_t*)malloc(sizeof(h3zero_capsule_t));
+
+    if (stream_bytes == NULL || capsule == NULL) {
+        ret = -1;
+    }
+    else {
+        uint8_t* bytes = stream_bytes;
+
+        memset(capsule, 0, sizeof(h3zero_capsule_t));
+        for (int i = 0; i < 2; i++) {
+            memcpy(bytes, capsule_datagram, sizeof(capsule_datagram));
+            bytes += sizeof(capsule_datagram);
+        }
+        bytes = picoquic_frames_varint_encode(bytes, bytes + 8, picowt_capsule_close_webtransport_session);
+        *bytes++ = (uint8_t)close_length;
+        memset(bytes, 'c', close_length);
+        bytes += close_length;
+        bytes = picoquic_frames_varint_encode(bytes, bytes + 8, picowt_capsule_close_webtransport_session);
+        bytes = picoquic_frames_varint_encode(bytes, bytes + 8, large_length);
+        memset(bytes, 'l', large_length);
+        bytes += large_length;
+        memcpy(bytes, capsule_datagram, sizeof(capsule_datagram));
+        bytes += sizeof(capsule_datagram);
+        stream_length = bytes - stream_bytes;
+    }
+
+    for (int pass = 0; ret == 0 && pass < 2; pass++) {
+        /* First pass in one chunk, second pass with the second datagram split */
+        size_t split = (pass == 0) ? stream_length : sizeof(capsule_datagram) + 3;
+        const uint8_t* bytes = stream_bytes;
+        const uint8_t* bytes_max = stream_bytes + split;
+        int nb_capsules = 0;
+
+        while (ret == 0 && bytes < stream_bytes + stream_length) {
+            if (bytes == bytes_max) {
+                bytes_max = stream_bytes + stream_length;
+            }
+            if ((bytes = h3zero_accumulate_capsule(bytes, bytes_max, capsule)) == NULL) {
+                ret = -1;
+            }
+            else if (capsule->is_stored) {
+                int is_borrowed_expected = nb_capsules == 0 || nb_capsules == 4 || (nb_capsules == 1 && pass == 0);
+                const uint8_t* expected_value = (!is_borrowed_expected) ? NULL : bytes - capsule->capsule_length;
+
+                if (nb_capsules == 2) {
+                    if (capsule->capsule_type != picowt_capsule_close_webtransport_session ||
+                        capsule->capsule_length != close_length || capsule->capsule_value != capsule->value_buffer ||
+                        capsule->capsule_value[0] != 'c') {
+                        ret = -1;
+                    }
+                }
+                else if (nb_capsules == 3) {
+                    if (capsule->capsule_length != large_length || capsule->capsule_buffer == NULL || capsule->is_value_borrowed ||
+                        capsule->capsule_value != capsule->capsule_buffer ||
+                        capsule->capsule_value[large_length - 1] != 'l') {
+                        ret = -1;
+                    }
+                }
+                else if (capsule->capsule_type != h3zero_capsule_type_datagram ||
+                    capsule->capsule_length != sizeof(capsule_datagram) - 2 ||
+                    memcmp(capsule->capsule_value, capsule_datagram + 2, capsule->capsule_length) != 0 ||
+                    (capsule->is_value_borrowed != 0) != is_borrowed_expected ||
+                    capsule->capsule_value != ((is_borrowed_expected) ? expected_value : capsule->value_buffer)) {
+                    ret = -1;
+                }
+                if (ret != 0) {
+                    DBG_PRINTF("Capsule %d not parsed as expected, pass %d", nb_capsules, pass);
+                }
+                nb_capsules++;
+            }
+        }
+
+        if (ret == 0 && nb_capsules != 5) {
+            DBG_PRINTF("Found %d capsules instead of 5, pass %d", nb_capsules, pass);
+            ret = -1;
+        }
+    }
+
+    if (capsule != NULL) {
+        h3zero_release_capsule(capsule);
+        free(capsule);
+    }
+    if (stream_bytes != NULL) {
+        free(stream_bytes);
+    }
+
+    return ret;
+}
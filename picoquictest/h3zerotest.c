@@ -28,6 +28,8 @@
 #include "tls_api.h"
 #include "h3zero.h"
 #include "h3zero_common.h"
+#include "connect_udp.h"
+#include "h3zero_cnx_pool.h"
 #include "democlient.h"
 #include "demoserver.h"
 #ifdef _WINDOWS
@@ -536,6 +538,203 @@ int qpack_huffman_base_test()
     return ret;
 }
 
+/* Test of QPACK Huffman encoding: the encoding of the test vectors shall
+ * match the values in RFC 7541, all octet values shall round trip, and
+ * the decoder shall reject EOS, bad padding and too long outputs. */
+int qpack_huffman_encode_test()
+{
+    int ret = 0;
+    uint8_t data[256];
+    uint8_t coded[1024];
+    uint8_t* coded_last;
+    size_t nb_data;
+
+    for (size_t i = 0; ret == 0 && i < nb_qpack_huffman_test_case; i++) {
+        coded_last = h3zero_qpack_huffman_encode(coded, coded + sizeof(coded),
+            qpack_huffman_test_case[i].result, qpack_huffman_test_case[i].result_size);
+        if (coded_last == NULL ||
+            (size_t)(coded_last - coded) != qpack_huffman_test_case[i].test_size ||
+            h3zero_qpack_huffman_length(qpack_huffman_test_case[i].result, qpack_huffman_test_case[i].result_size) !=
+            qpack_huffman_test_case[i].test_size ||
+            memcmp(coded, qpack_huffman_test_case[i].test, qpack_huffman_test_case[i].test_size) != 0) {
+            DBG_PRINTF("Huffman encoding test %d does not match\n", (int)i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        for (int i = 0; i < 256; i++) {
+            data[i] = (uint8_t)i;
+        }
+        coded_last = h3zero_qpack_huffman_encode(coded, coded + sizeof(coded), data, sizeof(data));
+        if (coded_last == NULL) {
+            DBG_PRINTF("%s", "Cannot encode all octet values\n");
+            ret = -1;
+        }
+        else {
+            for (int method = 0; ret == 0 && method < 2; method++) {
+                memset(data, 0, sizeof(data));
+                if (((method == 0) ? hzero_qpack_huffman_decode(coded, coded_last, data, sizeof(data), &nb_data) :
+                    hzero_qpack_huffman_decode_bitwise(coded, coded_last, data, sizeof(data), &nb_data)) != 0 ||
+                    nb_data != sizeof(data)) {
+                    DBG_PRINTF("Cannot decode all octet values, method %d\n", method);
+                    ret = -1;
+                }
+                for (int i = 0; ret == 0 && i < 256; i++) {
+                    if (data[i] != i) {
+                        DBG_PRINTF("Octet value %d does not round trip, method %d\n", i, method);
+                        ret = -1;
+                    }
+                }
+            }
+            /* The output is one octet too short */
+            if (ret == 0 && hzero_qpack_huffman_decode(coded, coded_last, data, sizeof(data) - 1, &nb_data) == 0) {
+                DBG_PRINTF("%s", "Huffman decoding does not detect overflow\n");
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* EOS is a decoding error */
+        uint8_t eos[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+        /* "a", then a padding with a zero bit */
+        uint8_t bad_pad[1] = { 0x1E };
+
+        if (hzero_qpack_huffman_decode(eos, eos + sizeof(eos), data, sizeof(data), &nb_data) == 0) {
+            DBG_PRINTF("%s", "Huffman decoding does not reject EOS\n");
+            ret = -1;
+        }
+        else if (hzero_qpack_huffman_decode(bad_pad, bad_pad + sizeof(bad_pad), data, sizeof(data), &nb_data) == 0) {
+            DBG_PRINTF("%s", "Huffman decoding does not reject bad padding\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Strings are only Huffman encoded if that makes them shorter */
+        uint8_t const * text = (uint8_t const*)"www.example.com";
+        uint8_t binary[4] = { 0, 1, 2, 3 };
+
+        coded_last = h3zero_qpack_string_encode(coded, coded + sizeof(coded), 0x00, 0x7F, text, 15);
+        if (coded_last == NULL || coded[0] != (0x80 | 12) || coded_last != coded + 13) {
+            DBG_PRINTF("%s", "Text string is not Huffman encoded\n");
+            ret = -1;
+        }
+        else if ((coded_last = h3zero_qpack_string_encode(coded, coded + sizeof(coded), 0x40, 0x1F, binary, sizeof(binary))) == NULL ||
+            coded[0] != (0x40 | 4) || coded_last != coded + 5 || memcmp(coded + 1, binary, sizeof(binary)) != 0) {
+            DBG_PRINTF("%s", "Binary string is not encoded as is\n");
+            ret = -1;
+        }
+        else if (h3zero_qpack_string_encode(coded, coded + 8, 0x00, 0x7F, text, 15) != NULL) {
+            DBG_PRINTF("%s", "String encoding does not detect overflow\n");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Benchmark of the Huffman decoders, using a set of header values
+ * typical of HTTP requests and responses. */
+#define QPACK_HUFFMAN_BENCH_NB_ROUNDS 2000
+
+static char const* qpack_huffman_bench_values[] = {
+    "www.example.com",
+    "/index.html",
+    "/assets/js/vendor.min.js?v=20240117",
+    "/api/v2/users/12345/profile?fields=name,email,avatar",
+    "text/html; charset=utf-8",
+    "application/json",
+    "gzip, deflate, br",
+    "en-US,en;q=0.9,fr;q=0.8",
+    "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36",
+    "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.2 Safari/605.1.15",
+    "max-age=31536000, immutable",
+    "no-cache, no-store, must-revalidate",
+    "Mon, 15 Jan 2024 08:12:31 GMT",
+    "\"33a64df551425fcc55e4d42a148795d9f25f89d4\"",
+    "session_id=38afes7a8; theme=dark; _ga=GA1.2.1234567890.1700000000",
+    "https://www.example.com/search?q=quic+transport",
+    "bytes=0-1023",
+    "u=3, i",
+    "h3=\":443\"; ma=86400"
+};
+
+static const size_t nb_qpack_huffman_bench_values = sizeof(qpack_huffman_bench_values) / sizeof(char const*);
+
+int qpack_huffman_bench_test()
+{
+    int ret = 0;
+    uint8_t coded[4096];
+    uint8_t* coded_end[sizeof(qpack_huffman_bench_values) / sizeof(char const*)];
+    uint8_t data[256];
+    size_t nb_data;
+    size_t raw_length = 0;
+    size_t coded_length = 0;
+    uint64_t sum[2] = { 0, 0 };
+    uint64_t duration[2] = { 0, 0 };
+    uint8_t* bytes = coded;
+
+    /* Encode the values, and verify that both decoders produce the original */
+    for (size_t i = 0; ret == 0 && i < nb_qpack_huffman_bench_values; i++) {
+        size_t length = strlen(qpack_huffman_bench_values[i]);
+        uint8_t* next = h3zero_qpack_huffman_encode(bytes, coded + sizeof(coded),
+            (uint8_t const*)qpack_huffman_bench_values[i], length);
+
+        if (next == NULL) {
+            ret = -1;
+        }
+        else {
+            for (int method = 0; ret == 0 && method < 2; method++) {
+                if (((method == 0) ? hzero_qpack_huffman_decode_bitwise(bytes, next, data, sizeof(data), &nb_data) :
+                    hzero_qpack_huffman_decode(bytes, next, data, sizeof(data), &nb_data)) != 0 ||
+                    nb_data != length || memcmp(data, qpack_huffman_bench_values[i], length) != 0) {
+                    DBG_PRINTF("Huffman bench value %d does not decode, method %d", (int)i, method);
+                    ret = -1;
+                }
+            }
+            raw_length += length;
+            coded_length += next - bytes;
+            coded_end[i] = next;
+            bytes = next;
+        }
+    }
+
+    for (int method = 0; ret == 0 && method < 2; method++) {
+        uint64_t start_time = picoquic_current_time();
+
+        for (int round = 0; ret == 0 && round < QPACK_HUFFMAN_BENCH_NB_ROUNDS; round++) {
+            bytes = coded;
+            for (size_t i = 0; ret == 0 && i < nb_qpack_huffman_bench_values; i++) {
+                if (((method == 0) ? hzero_qpack_huffman_decode_bitwise(bytes, coded_end[i], data, sizeof(data), &nb_data) :
+                    hzero_qpack_huffman_decode(bytes, coded_end[i], data, sizeof(data), &nb_data)) != 0) {
+                    ret = -1;
+                }
+                else {
+                    sum[method] += nb_data + data[nb_data - 1];
+                }
+                bytes = coded_end[i];
+            }
+        }
+        duration[method] = picoquic_current_time() - start_time;
+    }
+
+    if (ret == 0) {
+        if (sum[1] != sum[0]) {
+            DBG_PRINTF("%s", "Huffman decoding methods disagree");
+            ret = -1;
+        }
+        else {
+            DBG_PRINTF("Decoding %d strings, %" PRIst " bytes Huffman coded to %" PRIst ": bitwise %" PRIu64 "us, table %" PRIu64 "us",
+                (int)(nb_qpack_huffman_bench_values * QPACK_HUFFMAN_BENCH_NB_ROUNDS), raw_length, coded_length,
+                duration[0], duration[1]);
+        }
+    }
+
+    return ret;
+}
 
 #define QPACK_HUFFMAN_TXT "qpack_huffman.txt"
 
@@ -808,13 +1007,22 @@ static qpack_test_case_t qpack_test_case[] = {
 
 static size_t nb_qpack_test_case = sizeof(qpack_test_case) / sizeof(qpack_test_case_t);
 
-static int h3zero_parse_qpack_test_one(size_t i, uint8_t * data, size_t data_length)
+static int h3zero_parse_qpack_test_one_ex(size_t i, uint8_t * data, size_t data_length, int is_borrowed)
 {
     int ret = 0;
     uint8_t * bytes;
     h3zero_header_parts_t parts;
 
-    bytes = h3zero_parse_qpack_header_frame(data, data + data_length, &parts);
+    if (is_borrowed) {
+        uint64_t required_insert_count = 0;
+        int is_blocked = 0;
+
+        bytes = h3zero_parse_qpack_header_frame_borrowed(data, data + data_length, &parts, NULL, 0,
+            &required_insert_count, &is_blocked);
+    }
+    else {
+        bytes = h3zero_parse_qpack_header_frame(data, data + data_length, &parts);
+    }
 
     if (bytes == 0) {
         DBG_PRINTF("Qpack case %d cannot be parsed", i);
@@ -884,6 +1092,11 @@ static int h3zero_parse_qpack_test_one(size_t i, uint8_t * data, size_t data_len
     return ret;
 }
 
+static int h3zero_parse_qpack_test_one(size_t i, uint8_t * data, size_t data_length)
+{
+    return h3zero_parse_qpack_test_one_ex(i, data, data_length, 0);
+}
+
 int h3zero_parse_qpack_test()
 {
     int ret = 0;
@@ -899,6 +1112,96 @@ int h3zero_parse_qpack_test()
     return ret;
 }
 
+/* Parse the same test cases with borrowed views. Values that are sent
+ * as is shall point into the frame, Huffman coded values shall be decoded
+ * in the arena, even if longer than the 256 bytes decoding buffer. */
+int h3zero_parse_qpack_borrowed_test()
+{
+    int ret = 0;
+
+    for (size_t i = 0; ret == 0 && i < nb_qpack_test_case; i++) {
+        ret = h3zero_parse_qpack_test_one_ex(i,
+            qpack_test_case[i].bytes, qpack_test_case[i].bytes_length, 1);
+        if (ret != 0) {
+            DBG_PRINTF("Parse QPACK borrowed test %d fails.\n", i);
+        }
+    }
+
+    if (ret == 0) {
+        uint8_t frame[1024];
+        uint8_t path[600];
+        uint8_t* bytes = frame;
+        uint8_t* bytes_max = frame + sizeof(frame);
+        uint64_t required_insert_count = 0;
+        int is_blocked = 0;
+        h3zero_header_parts_t parts;
+
+        for (size_t i = 0; i < sizeof(path); i++) {
+            path[i] = (uint8_t)('a' + (i % 26));
+        }
+        path[0] = '/';
+
+        /* GET, long Huffman coded path, range sent as is */
+        *bytes++ = 0;
+        *bytes++ = 0;
+        *bytes++ = 0xC0 | 17;
+        *bytes = 0x50;
+        bytes = h3zero_qpack_int_encode(bytes, bytes_max, 0x0F, 1);
+        *bytes = 0x80;
+        bytes = h3zero_qpack_int_encode(bytes, bytes_max, 0x7F, h3zero_qpack_huffman_length(path, sizeof(path)));
+        bytes = h3zero_qpack_huffman_encode(bytes, bytes_max, path, sizeof(path));
+        if (bytes != NULL) {
+            *bytes = 0x20;
+            bytes = h3zero_qpack_int_encode(bytes, bytes_max, 0x07, 5);
+        }
+        if (bytes != NULL && bytes + 5 + 1 + QPACK_TEST_VALUE_RANGE10_LEN <= bytes_max) {
+            uint8_t range_line[] = { 'r', 'a', 'n', 'g', 'e', QPACK_TEST_VALUE_RANGE10_LEN, QPACK_TEST_VALUE_RANGE10 };
+            memcpy(bytes, range_line, sizeof(range_line));
+            bytes += sizeof(range_line);
+        }
+        else {
+            bytes = NULL;
+        }
+
+        if (bytes == NULL) {
+            DBG_PRINTF("%s", "Cannot prepare the long path frame\n");
+            ret = -1;
+        }
+        else if (h3zero_parse_qpack_header_frame_borrowed(frame, bytes, &parts, NULL, 0,
+            &required_insert_count, &is_blocked) != bytes) {
+            DBG_PRINTF("%s", "Cannot parse the long path frame\n");
+            ret = -1;
+        }
+        else {
+            if (parts.method != h3zero_method_get || parts.path_length != sizeof(path) ||
+                memcmp(parts.path, path, sizeof(path)) != 0) {
+                DBG_PRINTF("%s", "Long Huffman path not decoded\n");
+                ret = -1;
+            }
+            else if (parts.path >= frame && parts.path < bytes) {
+                DBG_PRINTF("%s", "Huffman path not decoded in the arena\n");
+                ret = -1;
+            }
+            else if (parts.range_length != QPACK_TEST_VALUE_RANGE10_LEN ||
+                parts.range != bytes - QPACK_TEST_VALUE_RANGE10_LEN) {
+                DBG_PRINTF("%s", "Range is not a view of the frame\n");
+                ret = -1;
+            }
+            else if (parts.arena == NULL || parts.arena->next != NULL) {
+                DBG_PRINTF("%s", "Expected a single arena block\n");
+                ret = -1;
+            }
+        }
+        h3zero_release_header_parts(&parts);
+        if (ret == 0 && (parts.path != NULL || parts.range != NULL || parts.arena != NULL)) {
+            DBG_PRINTF("%s", "Header parts not released\n");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
 /*
  * Prepare frames of the different supported types, and 
  * verify that they can be decoded as expected
@@ -2337,28 +2640,145 @@ int h09_post_test()
         post_test_stream_length, 0, 0, 0, 0, NULL, NULL, NULL, 0);
 }
 
-int demo_file_sanitize_test()
+/* Test the backpressure on POST data. The callback withholds all the body
+ * data until it holds at least H3ZERO_BACKPRESSURE_HOLD bytes, checking that
+ * the stream credit is not renewed meanwhile. After that, it consumes the
+ * data one callback late, until the end of the body.
+ */
+#define H3ZERO_BACKPRESSURE_POST_SIZE 200000
+#define H3ZERO_BACKPRESSURE_HOLD 50000
+#define H3ZERO_BACKPRESSURE_RESPONSE 1024
+
+typedef struct st_h3zero_backpressure_test_ctx_t {
+    uint64_t initial_max_data;
+    size_t nb_received;
+    size_t nb_held;
+    size_t nb_sent;
+    int nb_errors;
+    unsigned int is_released : 1;
+    unsigned int is_fin_received : 1;
+} h3zero_backpressure_test_ctx_t;
+
+static h3zero_backpressure_test_ctx_t backpressure_test_ctx;
+
+int h3zero_test_backpressure_callback(picoquic_cnx_t* cnx,
+    uint8_t* bytes, size_t length,
+    picohttp_call_back_event_t event, h3zero_stream_ctx_t* stream_ctx,
+    void* callback_ctx)
 {
     int ret = 0;
-    char const* good[] = {
-        "/index.html", "/example.com.txt", "/5000000", "/123_45.png", "/a-b-C-Z", "/dir/index.html"
-    };
-    size_t nb_good = sizeof(good) / sizeof(char const*);
-    char const* bad[] = {
-        "/../index.html", "example.com.txt", "/5000000/", "/.123_45.png", "/a-b-C-Z\\..\\password.txt", "//remote-server/example"
-    };
-    size_t nb_bad = sizeof(bad) / sizeof(char const*);
+    h3zero_backpressure_test_ctx_t* ctx = &backpressure_test_ctx;
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_ctx->stream_id);
 
-    for (size_t i = 0; ret == 0 && i < nb_good; i++) {
-        if (demo_server_is_path_sane((uint8_t*)good[i], strlen(good[i])) != 0) {
-            DBG_PRINTF("Found good frame not good: %s\n", good[i]);
+    switch (event) {
+    case picohttp_callback_post:
+        stream_ctx->path_callback_ctx = ctx;
+        if (h3zero_set_post_backpressure(cnx, stream_ctx) != 0) {
+            ctx->nb_errors++;
+        }
+        break;
+    case picohttp_callback_post_data:
+        if (stream == NULL) {
+            ctx->nb_errors++;
+            break;
+        }
+        if (ctx->nb_received == 0) {
+            ctx->initial_max_data = stream->maxdata_local;
+        }
+        ctx->nb_received += length;
+        if (!ctx->is_released) {
+            if (stream->maxdata_local != ctx->initial_max_data) {
+                DBG_PRINTF("Credit renewed to %" PRIu64 " while data is withheld", stream->maxdata_local);
+                ctx->nb_errors++;
+            }
+            ctx->nb_held += length;
+            if (ctx->nb_held >= H3ZERO_BACKPRESSURE_HOLD) {
+                ctx->is_released = 1;
+                ret = h3zero_post_data_consumed(cnx, stream_ctx, ctx->nb_held);
+                ctx->nb_held = 0;
+            }
+        }
+        else {
+            /* Consume the data received in the previous callback */
+            ret = h3zero_post_data_consumed(cnx, stream_ctx, ctx->nb_held);
+            ctx->nb_held = length;
+        }
+        break;
+    case picohttp_callback_post_fin:
+        /* The bytes point to the response buffer, not to posted data */
+        ctx->is_fin_received = 1;
+        if (h3zero_post_data_consumed(cnx, stream_ctx, ctx->nb_held) != 0 || stream_ctx->post_backlog != 0) {
+            ctx->nb_errors++;
+        }
+        ctx->nb_held = 0;
+        ret = H3ZERO_BACKPRESSURE_RESPONSE;
+        break;
+    case picohttp_callback_provide_data:
+    {
+        uint8_t* buffer;
+        size_t available = H3ZERO_BACKPRESSURE_RESPONSE - ctx->nb_sent;
+        int is_fin = 1;
+
+        if (available > length) {
+            available = length;
+            is_fin = 0;
+        }
+        buffer = picoquic_provide_stream_data_buffer(bytes, available, is_fin, !is_fin);
+        if (buffer == NULL) {
             ret = -1;
         }
+        else {
+            memset(buffer, 'b', available);
+            ctx->nb_sent += available;
+        }
+        break;
+    }
+    case picohttp_callback_free:
+        stream_ctx->path_callback = NULL;
+        stream_ctx->path_callback_ctx = NULL;
+        break;
+    default:
+        break;
     }
 
-    for (size_t i = 0; ret == 0 && i < nb_bad; i++) {
-        if (demo_server_is_path_sane((uint8_t*)bad[i], strlen(bad[i])) == 0) {
-            DBG_PRINTF("Found bad frame not bad: %s\n", bad[i]);
+    return ret;
+}
+
+static const picoquic_demo_stream_desc_t backpressure_test_scenario[] = {
+    { 0, 0, PICOQUIC_DEMO_STREAM_ID_INITIAL, "/upload", "upload-test.html", H3ZERO_BACKPRESSURE_POST_SIZE }
+};
+
+static const size_t backpressure_test_stream_length[] = { H3ZERO_BACKPRESSURE_RESPONSE };
+
+picohttp_server_path_item_t backpressure_test_item = {
+    "/upload",
+    7,
+    h3zero_test_backpressure_callback,
+    NULL
+};
+
+picohttp_server_parameters_t backpressure_test_param = {
+    NULL,
+    &backpressure_test_item,
+    1
+};
+
+int h3zero_post_backpressure_test()
+{
+    int ret;
+
+    memset(&backpressure_test_ctx, 0, sizeof(backpressure_test_ctx));
+    ret = demo_server_test(PICOHTTP_ALPN_H3_LATEST, h3zero_callback, (void*)&backpressure_test_param,
+        backpressure_test_scenario, 1, backpressure_test_stream_length, 0, 0, 0, 0, NULL, NULL, NULL, 0);
+
+    if (ret == 0) {
+        if (backpressure_test_ctx.nb_errors != 0) {
+            DBG_PRINTF("Found %d backpressure errors", backpressure_test_ctx.nb_errors);
+            ret = -1;
+        }
+        else if (!backpressure_test_ctx.is_released || !backpressure_test_ctx.is_fin_received ||
+            backpressure_test_ctx.nb_received != H3ZERO_BACKPRESSURE_POST_SIZE) {
+            DBG_PRINTF("Received %zu bytes out of %d", backpressure_test_ctx.nb_received, H3ZERO_BACKPRESSURE_POST_SIZE);
             ret = -1;
         }
     }
@@ -2366,55 +2786,225 @@ int demo_file_sanitize_test()
     return ret;
 }
 
-int demo_file_access_test()
+/* Test of the pipelined mode of the demo client. The scenario opens
+ * 14 requests, some of them repeated and some of them depending on the
+ * last repeat of a previous stream, while keeping at most 4 requests open.
+ */
+#define DEMO_PIPELINE_TEST_MAX_CONCURRENT 4
+
+static const picoquic_demo_stream_desc_t pipeline_test_scenario[] = {
+    { 0, 0, PICOQUIC_DEMO_STREAM_ID_INITIAL, "/", "root.html", 0 },
+    { 8, 4, 0, "4000", "pipe-4000.txt", 0 },
+    { 4, 100, PICOQUIC_DEMO_STREAM_ID_INITIAL, "2000", "pipe-2000.txt", 0 },
+    { 0, 200, 112, "1000", "pipe-1000.txt", 0 }
+};
+
+static size_t const nb_pipeline_test_scenario = sizeof(pipeline_test_scenario) / sizeof(picoquic_demo_stream_desc_t);
+
+static size_t const pipeline_test_stream_length[] = { 128, 4000, 2000, 1000 };
+
+int demo_pipeline_test()
 {
-    int ret = 0;
-#ifdef _WINDOWS
-    char const* folder = ".\\";
-#else
-    char const* folder = "./";
-#endif
-    char const* path = "/x1234x5678.zzz";
-    char const* bad_path = "/../etc/passwd";
-    size_t f_size = 0;
-    uint64_t echo_size = 0;
-    char buf[128];
-    char* file_path;
-    const int nb_blocks = 16;
-    int file_error = 0;
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    uint64_t time_out;
+    uint64_t nb_expected = 0;
+    int nb_trials = 0;
+    int was_active = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    picoquic_demo_callback_ctx_t callback_ctx;
+    picoquic_demo_pipeline_t* pipeline = picoquic_demo_pipeline_create(DEMO_PIPELINE_TEST_MAX_CONCURRENT, 1, NULL);
+    picoquic_connection_id_t initial_cid = { {0xde, 0x91, 0xe1, 4, 5, 6, 7, 8}, 8 };
+    int ret = picoquic_demo_client_initialize_context(&callback_ctx, pipeline_test_scenario, nb_pipeline_test_scenario,
+        PICOHTTP_ALPN_H3_LATEST, 1, 0);
 
-    FILE* F = picoquic_file_open(path + 1, "wb");
+    callback_ctx.no_print = 1;
+    callback_ctx.pipeline = pipeline;
 
-    if (F == NULL) {
-        DBG_PRINTF("Cannot create file: %s", path + 1);
-        ret = -1;
+    for (size_t i = 0; i < nb_pipeline_test_scenario; i++) {
+        nb_expected += (pipeline_test_scenario[i].repeat_count == 0) ? 1 : pipeline_test_scenario[i].repeat_count;
     }
-    else {
-        for (int i = 0; i < nb_blocks; i++) {
-            memset(buf, i, sizeof(buf));
-            fwrite(buf, 1, sizeof(buf), F);
-            f_size += sizeof(buf);
-        }
-        F = picoquic_file_close(F);
+
+    if (pipeline == NULL) {
+        ret = -1;
     }
 
     if (ret == 0) {
-        ret = demo_server_try_file_path((uint8_t*)path, strlen(path), &echo_size,
-            &file_path, folder, &file_error);
-        if (ret != 0) {
-            DBG_PRINTF("Could not try file path <%s> <%s>, ret = %d, err = 0x%x", folder, path, ret, file_error);
-        }
-        else if (echo_size != f_size) {
-            DBG_PRINTF("Found size = %d instead of %d", (int)echo_size, (int)f_size);
+        ret = tls_api_init_ctx_ex(&test_ctx,
+            PICOQUIC_INTERNAL_TEST_VERSION_1,
+            PICOQUIC_TEST_SNI, PICOHTTP_ALPN_H3_LATEST, &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+        if (ret == 0 && (test_ctx == NULL || test_ctx->cnx_client == NULL || test_ctx->qserver == NULL)) {
             ret = -1;
         }
-        else {
-            F = picoquic_file_open(file_path, "rb");
-            if (F == NULL) {
-                DBG_PRINTF("Could not open file path: <%s>", file_path);
-                ret = -1;
-            }
-            else {
+    }
+
+    if (ret == 0) {
+        picoquic_set_alpn_select_fn(test_ctx->qserver, picoquic_demo_server_callback_select_alpn);
+        picoquic_set_default_callback(test_ctx->qserver, h3zero_callback, NULL);
+        picoquic_set_callback(test_ctx->cnx_client, picoquic_demo_client_callback, &callback_ctx);
+        ret = picoquic_start_client_cnx(test_ctx->cnx_client);
+    }
+
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    if (ret == 0) {
+        ret = picoquic_demo_client_start_streams(test_ctx->cnx_client, &callback_ctx, PICOQUIC_DEMO_STREAM_ID_INITIAL);
+    }
+
+    time_out = simulated_time + 30000000;
+    while (ret == 0 && picoquic_get_cnx_state(test_ctx->cnx_client) != picoquic_state_disconnected) {
+        ret = tls_api_one_sim_round(test_ctx, &simulated_time, time_out, &was_active);
+
+        if (ret == 0 && (pipeline->nb_open > DEMO_PIPELINE_TEST_MAX_CONCURRENT ||
+            callback_ctx.nb_open_streams != pipeline->nb_open)) {
+            DBG_PRINTF("Pipeline has %zu requests open, client %d", pipeline->nb_open, callback_ctx.nb_open_streams);
+            ret = -1;
+        }
+
+        if (ret == 0 && picoquic_get_cnx_state(test_ctx->cnx_client) < picoquic_state_disconnecting &&
+            picoquic_demo_pipeline_is_done(pipeline)) {
+            ret = picoquic_close(test_ctx->cnx_client, 0);
+        }
+
+        if (++nb_trials > 100000) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        if (pipeline->nb_requests != nb_expected || pipeline->nb_completed != nb_expected || pipeline->nb_reset != 0) {
+            DBG_PRINTF("Expected %" PRIu64 " requests, sent %" PRIu64 ", completed %" PRIu64 ", reset %" PRIu64,
+                nb_expected, pipeline->nb_requests, pipeline->nb_completed, pipeline->nb_reset);
+            ret = -1;
+        }
+        else if (pipeline->duration.count != nb_expected || pipeline->first_byte.count != nb_expected ||
+            pipeline->first_byte.max > pipeline->duration.max) {
+            DBG_PRINTF("Unexpected timing counts, %" PRIu64 " durations, %" PRIu64 " first bytes",
+                pipeline->duration.count, pipeline->first_byte.count);
+            ret = -1;
+        }
+    }
+
+    /* The stream IDs are allocated by the connection, while the scenario
+     * IDs are only used for the dependencies. */
+    if (ret == 0) {
+        picoquic_demo_client_stream_ctx_t* stream = callback_ctx.first_stream;
+        uint64_t nb_streams = 0;
+
+        while (ret == 0 && stream != NULL) {
+            if (stream->is_open || stream->received_length < pipeline_test_stream_length[stream->scenario_index] ||
+                stream->stream_id >= 4 * nb_expected || (stream->stream_id & 3) != 0) {
+                DBG_PRINTF("Unexpected state of stream %" PRIu64 ", scenario %" PRIu64 ", %" PRIu64 " bytes",
+                    stream->stream_id, stream->scenario_stream_id, stream->received_length);
+                ret = -1;
+            }
+            nb_streams++;
+            stream = stream->next_stream;
+        }
+        if (ret == 0 && nb_streams != nb_expected) {
+            DBG_PRINTF("Found %" PRIu64 " streams instead of %" PRIu64, nb_streams, nb_expected);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && picoquic_demo_pipeline_report(stdout, pipeline) != 0) {
+        ret = -1;
+    }
+
+    picoquic_demo_client_delete_context(&callback_ctx);
+
+    if (pipeline != NULL) {
+        picoquic_demo_pipeline_delete(pipeline);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    return ret;
+}
+
+int demo_file_sanitize_test()
+{
+    int ret = 0;
+    char const* good[] = {
+        "/index.html", "/example.com.txt", "/5000000", "/123_45.png", "/a-b-C-Z", "/dir/index.html"
+    };
+    size_t nb_good = sizeof(good) / sizeof(char const*);
+    char const* bad[] = {
+        "/../index.html", "example.com.txt", "/5000000/", "/.123_45.png", "/a-b-C-Z\\..\\password.txt", "//remote-server/example"
+    };
+    size_t nb_bad = sizeof(bad) / sizeof(char const*);
+
+    for (size_t i = 0; ret == 0 && i < nb_good; i++) {
+        if (demo_server_is_path_sane((uint8_t*)good[i], strlen(good[i])) != 0) {
+            DBG_PRINTF("Found good frame not good: %s\n", good[i]);
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_bad; i++) {
+        if (demo_server_is_path_sane((uint8_t*)bad[i], strlen(bad[i])) == 0) {
+            DBG_PRINTF("Found bad frame not bad: %s\n", bad[i]);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int demo_file_access_test()
+{
+    int ret = 0;
+#ifdef _WINDOWS
+    char const* folder = ".\\";
+#else
+    char const* folder = "./";
+#endif
+    char const* path = "/x1234x5678.zzz";
+    char const* bad_path = "/../etc/passwd";
+    size_t f_size = 0;
+    uint64_t echo_size = 0;
+    char buf[128];
+    char* file_path;
+    const int nb_blocks = 16;
+    int file_error = 0;
+
+    FILE* F = picoquic_file_open(path + 1, "wb");
+
+    if (F == NULL) {
+        DBG_PRINTF("Cannot create file: %s", path + 1);
+        ret = -1;
+    }
+    else {
+        for (int i = 0; i < nb_blocks; i++) {
+            memset(buf, i, sizeof(buf));
+            fwrite(buf, 1, sizeof(buf), F);
+            f_size += sizeof(buf);
+        }
+        F = picoquic_file_close(F);
+    }
+
+    if (ret == 0) {
+        ret = demo_server_try_file_path((uint8_t*)path, strlen(path), &echo_size,
+            &file_path, folder, &file_error);
+        if (ret != 0) {
+            DBG_PRINTF("Could not try file path <%s> <%s>, ret = %d, err = 0x%x", folder, path, ret, file_error);
+        }
+        else if (echo_size != f_size) {
+            DBG_PRINTF("Found size = %d instead of %d", (int)echo_size, (int)f_size);
+            ret = -1;
+        }
+        else {
+            F = picoquic_file_open(file_path, "rb");
+            if (F == NULL) {
+                DBG_PRINTF("Could not open file path: <%s>", file_path);
+                ret = -1;
+            }
+            else {
                 for (int i = 0; ret == 0 && i < nb_blocks; i++) {
                     int nb_read = (int)fread(buf, 1, sizeof(buf), F);
                     if (nb_read != (int)sizeof(buf)) {
@@ -2474,6 +3064,142 @@ int demo_file_access_test()
     return ret;
 }
 
+/* Test the negotiation of precompressed variants: parsing of the
+ * accept-encoding header, selection of the sibling file, and
+ * encoding of the response header. */
+typedef struct st_accept_encoding_test_case_t {
+    char const* value;
+    uint8_t accepted;
+} accept_encoding_test_case_t;
+
+#define ACCEPT_GZIP H3ZERO_ACCEPT_ENCODING(h3zero_content_encoding_gzip)
+#define ACCEPT_BR H3ZERO_ACCEPT_ENCODING(h3zero_content_encoding_br)
+#define ACCEPT_ZSTD H3ZERO_ACCEPT_ENCODING(h3zero_content_encoding_zstd)
+
+static const accept_encoding_test_case_t accept_encoding_test_case[] = {
+    { "gzip, deflate, br", ACCEPT_GZIP | ACCEPT_BR },
+    { "br;q=0, *", ACCEPT_GZIP | ACCEPT_ZSTD },
+    { "GZIP;q=0.5, zstd", ACCEPT_GZIP | ACCEPT_ZSTD },
+    { " br , x-gzip;q=1", ACCEPT_GZIP | ACCEPT_BR },
+    { "gzip;q=0.000", 0 },
+    { "*;q=0", 0 },
+    { "identity", 0 },
+    { "", 0 }
+};
+
+static const size_t nb_accept_encoding_test_case = sizeof(accept_encoding_test_case) / sizeof(accept_encoding_test_case_t);
+
+int demo_file_encoding_test()
+{
+    int ret = 0;
+#ifdef _WINDOWS
+    char const* folder = ".\\";
+#else
+    char const* folder = "./";
+#endif
+    char const* path = "/x1234x5679.html";
+    char const* file_names[2] = { "x1234x5679.html", "x1234x5679.html.br" };
+    size_t file_sizes[2] = { 1024, 256 };
+    uint64_t echo_size = 0;
+    char* file_path = NULL;
+    int file_error = 0;
+    h3zero_content_encoding_enum content_encoding;
+
+    for (size_t i = 0; ret == 0 && i < nb_accept_encoding_test_case; i++) {
+        uint8_t accepted = h3zero_parse_accept_encoding((uint8_t const*)accept_encoding_test_case[i].value,
+            strlen(accept_encoding_test_case[i].value));
+        if (accepted != accept_encoding_test_case[i].accepted) {
+            DBG_PRINTF("Accept encoding <%s> parsed as 0x%x instead of 0x%x", accept_encoding_test_case[i].value,
+                accepted, accept_encoding_test_case[i].accepted);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* GET with the static entry "accept-encoding: gzip, deflate, br" */
+        uint8_t request[] = { 0, 0, 0xC0 | H3ZERO_QPACK_CODE_GET, 0xC0 | 31 };
+        h3zero_header_parts_t parts;
+
+        if (h3zero_parse_qpack_header_frame(request, request + sizeof(request), &parts) != request + sizeof(request) ||
+            parts.accept_encoding != (ACCEPT_GZIP | ACCEPT_BR)) {
+            DBG_PRINTF("%s", "Static accept encoding not parsed");
+            ret = -1;
+        }
+        h3zero_release_header_parts(&parts);
+    }
+
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        FILE* F = picoquic_file_open(file_names[i], "wb");
+
+        if (F == NULL) {
+            DBG_PRINTF("Cannot create file: %s", file_names[i]);
+            ret = -1;
+        }
+        else {
+            for (size_t j = 0; j < file_sizes[i]; j++) {
+                fputc('a' + i, F);
+            }
+            F = picoquic_file_close(F);
+        }
+    }
+
+    if (ret == 0) {
+        if (h3zero_server_try_encoded_path((uint8_t*)path, strlen(path), ACCEPT_GZIP | ACCEPT_BR, &echo_size,
+            &file_path, folder, &file_error, &content_encoding) != 0) {
+            DBG_PRINTF("%s", "Precompressed variant not found");
+            ret = -1;
+        }
+        else if (content_encoding != h3zero_content_encoding_br || echo_size != file_sizes[1] ||
+            strcmp(h3zero_server_encoding_suffix(content_encoding), ".br") != 0) {
+            DBG_PRINTF("Found encoding %d, size %" PRIu64, content_encoding, echo_size);
+            ret = -1;
+        }
+        if (file_path != NULL) {
+            free(file_path);
+            file_path = NULL;
+        }
+    }
+
+    if (ret == 0) {
+        if (h3zero_server_try_encoded_path((uint8_t*)path, strlen(path), ACCEPT_GZIP | ACCEPT_ZSTD, &echo_size,
+            &file_path, folder, &file_error, &content_encoding) == 0 ||
+            content_encoding != h3zero_content_encoding_identity) {
+            DBG_PRINTF("%s", "Found a variant that is not present");
+            ret = -1;
+        }
+        if (file_path != NULL) {
+            free(file_path);
+            file_path = NULL;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        (void)remove(file_names[i]);
+    }
+
+    for (int i = h3zero_content_encoding_identity; ret == 0 && i <= h3zero_content_encoding_zstd; i++) {
+        uint8_t buffer[256];
+        uint8_t* bytes = h3zero_create_encoded_response_header_frame(buffer, buffer + sizeof(buffer),
+            h3zero_content_type_text_html, (h3zero_content_encoding_enum)i, NULL);
+        h3zero_header_parts_t parts;
+
+        if (bytes == NULL) {
+            DBG_PRINTF("Cannot encode response header for encoding %d", i);
+            ret = -1;
+        }
+        else {
+            if (h3zero_parse_qpack_header_frame(buffer, bytes, &parts) != bytes ||
+                parts.status != 200 || parts.content_type != h3zero_content_type_text_html) {
+                DBG_PRINTF("Cannot parse response header for encoding %d", i);
+                ret = -1;
+            }
+            h3zero_release_header_parts(&parts);
+        }
+    }
+
+    return ret;
+}
+
 
 #define PICOQUIC_TEST_FILE_DEMO_FOLDER "picoquictest"
 
@@ -2554,6 +3280,1194 @@ int demo_server_file_test()
     return ret;
 }
 
+/* Test of the file cache: sources are shared, least recently used sources
+ * are evicted if not referenced, and changed files are mapped again. */
+static int h3zero_file_cache_test_compare(h3zero_file_source_t* source, char const* file_path)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_path, "rb");
+
+    if (F == NULL || source == NULL) {
+        ret = -1;
+    }
+    else {
+        uint8_t buffer[512];
+        size_t offset = 0;
+        size_t nb_read;
+
+        while (ret == 0 && (nb_read = fread(buffer, 1, sizeof(buffer), F)) > 0) {
+            if (offset + nb_read > source->length || memcmp(source->data + offset, buffer, nb_read) != 0) {
+                ret = -1;
+            }
+            offset += nb_read;
+        }
+        if (ret == 0 && offset != source->length) {
+            ret = -1;
+        }
+    }
+    if (F != NULL) {
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+static int h3zero_file_cache_test_write(char const* file_path, size_t length)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_path, "wb");
+
+    if (F == NULL) {
+        ret = -1;
+    }
+    else {
+        for (size_t i = 0; ret == 0 && i < length; i++) {
+            if (fputc('a' + (int)(i % 26), F) == EOF) {
+                ret = -1;
+            }
+        }
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+int h3zero_file_cache_test()
+{
+    int ret = 0;
+    char const* file_names[3] = { "file_test_ref.txt", "ReadMe.txt", "config_usage_ref.txt" };
+    char file_path[3][1024];
+    char const* changed_path = "h3zero_file_cache_test.txt";
+    h3zero_file_source_t* source[3] = { NULL, NULL, NULL };
+    h3zero_file_source_t* other = NULL;
+    h3zero_file_cache_t* cache = h3zero_file_cache_create(2, 0);
+
+    if (cache == NULL) {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        char folder[512];
+        size_t len;
+
+        if ((ret = picoquic_get_input_path(folder, sizeof(folder), picoquic_solution_dir, PICOQUIC_TEST_FILE_DEMO_FOLDER)) == 0) {
+            ret = picoquic_sprintf(file_path[i], sizeof(file_path[i]), &len, "%s%s%s", folder, PICOQUIC_FILE_SEPARATOR, file_names[i]);
+        }
+    }
+
+    if (ret == 0) {
+        /* Two opens of the same file share the source */
+        source[0] = h3zero_file_cache_open(cache, file_path[0]);
+        other = h3zero_file_cache_open(cache, file_path[0]);
+        if (source[0] == NULL || other != source[0] || source[0]->ref_count != 2 ||
+            cache->nb_misses != 1 || cache->nb_hits != 1) {
+            DBG_PRINTF("%s", "File source is not shared");
+            ret = -1;
+        }
+        else if (h3zero_file_cache_test_compare(source[0], file_path[0]) != 0) {
+            DBG_PRINTF("%s", "Mapped file does not match");
+            ret = -1;
+        }
+        h3zero_file_source_release(other);
+        other = NULL;
+    }
+
+    if (ret == 0) {
+        /* With the first file referenced, the second one can be added, but not the third */
+        source[1] = h3zero_file_cache_open(cache, file_path[1]);
+        if (source[1] == NULL || h3zero_file_cache_open(cache, file_path[2]) != NULL) {
+            DBG_PRINTF("%s", "Referenced sources should not be evicted");
+            ret = -1;
+        }
+        else {
+            /* Once released, the first file is the least recently used */
+            h3zero_file_source_release(source[0]);
+            source[0] = NULL;
+            source[2] = h3zero_file_cache_open(cache, file_path[2]);
+            if (source[2] == NULL || cache->nb_sources != 2 || cache->last != source[1] ||
+                h3zero_file_cache_test_compare(source[2], file_path[2]) != 0) {
+                DBG_PRINTF("%s", "Least recently used source not evicted");
+                ret = -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        h3zero_file_source_release(source[i]);
+        source[i] = NULL;
+    }
+
+    if (ret == 0 && (ret = h3zero_file_cache_test_write(changed_path, 1000)) == 0) {
+        /* Files that change are mapped again. The stale mapping stays
+         * valid as long as it is referenced. */
+        other = h3zero_file_cache_open(cache, changed_path);
+        if (other == NULL || other->length != 1000 ||
+            (ret = h3zero_file_cache_test_write(changed_path, 2000)) != 0) {
+            ret = -1;
+        }
+        else if ((source[0] = h3zero_file_cache_open(cache, changed_path)) == NULL ||
+            source[0] == other || source[0]->length != 2000 || other->cache != NULL ||
+            h3zero_file_cache_test_compare(source[0], changed_path) != 0) {
+            DBG_PRINTF("%s", "Changed file is not mapped again");
+            ret = -1;
+        }
+        h3zero_file_source_release(other);
+        h3zero_file_source_release(source[0]);
+    }
+
+    h3zero_file_cache_delete(cache);
+
+    return ret;
+}
+
+/* Serve the file test scenario from the file cache */
+int h3zero_file_cache_serve_test()
+{
+    int ret = 0;
+    char file_name_buffer[1024];
+    picohttp_server_parameters_t file_param;
+
+    ret = serve_file_test_set_param(&file_param, file_name_buffer, sizeof(file_name_buffer));
+
+    if (ret == 0 && (file_param.file_cache = h3zero_file_cache_create(0, 0)) == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0 && (ret = demo_server_test(PICOHTTP_ALPN_H3_LATEST, h3zero_callback, (void*)&file_param,
+        file_test_scenario, nb_file_test_scenario, demo_file_test_stream_length, 0, 0, 0, 0, NULL, NULL, NULL, 0)) != 0) {
+        DBG_PRINTF("H3 server (%s) file cache test fails, ret = %d\n", PICOHTTP_ALPN_H3_LATEST, ret);
+    }
+    else if (ret == 0) {
+        ret = file_test_compare(&file_param, &file_test_scenario[0]);
+        if (ret == 0 && (file_param.file_cache->nb_misses != 1 || file_param.file_cache->first == NULL ||
+            file_param.file_cache->first->ref_count != 0)) {
+            DBG_PRINTF("%s", "File was not served from the cache");
+            ret = -1;
+        }
+    }
+
+    h3zero_file_cache_delete(file_param.file_cache);
+
+    return ret;
+}
+
+/* Test of the stream context index and pool: contexts are found through
+ * the index, or through the tree if they do not fit in the index, and
+ * deleted contexts are reused. Stream prefixes are indexed and pooled in
+ * the same way. */
+static int h3zero_stream_index_test_prefix(h3zero_callback_ctx_t* ctx, uint64_t far_id)
+{
+    int ret = 0;
+
+    for (uint64_t i = 0; ret == 0 && i < 100; i++) {
+        ret = h3zero_declare_stream_prefix(ctx, 4 * i, NULL, NULL);
+    }
+    if (ret == 0 && (ret = h3zero_declare_stream_prefix(ctx, far_id, NULL, NULL)) == 0 &&
+        (ctx->stream_prefixes.nb_not_indexed != 1 || h3zero_declare_stream_prefix(ctx, 8, NULL, NULL) == 0)) {
+        DBG_PRINTF("%s", "Stream prefixes not indexed as expected");
+        ret = -1;
+    }
+    for (uint64_t i = 0; ret == 0 && i < 100; i++) {
+        h3zero_stream_prefix_t* prefix_ctx = h3zero_find_stream_prefix(ctx, 4 * i);
+        if (prefix_ctx == NULL || prefix_ctx->prefix != 4 * i) {
+            DBG_PRINTF("Stream prefix %" PRIu64 " not found", 4 * i);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        h3zero_delete_stream_prefix(NULL, ctx, 40);
+        h3zero_delete_stream_prefix(NULL, ctx, far_id);
+        if (h3zero_find_stream_prefix(ctx, 40) != NULL || h3zero_find_stream_prefix(ctx, far_id) != NULL ||
+            h3zero_find_stream_prefix(ctx, 44) == NULL || ctx->stream_prefixes.nb_not_indexed != 0) {
+            DBG_PRINTF("%s", "Deleted stream prefixes still found");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        h3zero_stream_prefix_t* pooled = ctx->stream_prefixes.pool;
+        h3zero_stream_prefix_t* prefix_ctx = NULL;
+
+        if (ctx->stream_prefixes.nb_pooled != 2 || h3zero_declare_stream_prefix(ctx, 400, NULL, NULL) != 0 ||
+            (prefix_ctx = h3zero_find_stream_prefix(ctx, 400)) != pooled ||
+            ctx->stream_prefixes.nb_reused != 1 || ctx->stream_prefixes.nb_pooled != 1 ||
+            prefix_ctx->prefix != 400 || prefix_ctx->nb_queued_datagrams != 0 ||
+            prefix_ctx->datagram_urgency != H3ZERO_PRIORITY_URGENCY_DEFAULT) {
+            DBG_PRINTF("%s", "Pooled stream prefix not reused");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int h3zero_stream_index_test()
+{
+    int ret = 0;
+    const uint64_t nb_streams = 1000;
+    const uint64_t far_id = 4ull * 2ull * PICORADIX_MAX_PAGES * PICORADIX_PAGE_SIZE;
+    h3zero_callback_ctx_t* ctx = h3zero_callback_create_context(NULL);
+    h3zero_stream_ctx_t* stream_ctx = NULL;
+
+    if (ctx == NULL) {
+        ret = -1;
+    }
+
+    for (uint64_t i = 0; ret == 0 && i < nb_streams; i++) {
+        if (h3zero_find_or_create_stream(NULL, 4 * i, ctx, 1, 1) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && ((stream_ctx = h3zero_find_or_create_stream(NULL, far_id, ctx, 1, 1)) == NULL ||
+        stream_ctx->is_indexed || ctx->nb_streams_not_indexed != 1)) {
+        DBG_PRINTF("%s", "Stream outside of the index window not handled");
+        ret = -1;
+    }
+
+    for (uint64_t i = 0; ret == 0 && i < nb_streams; i++) {
+        stream_ctx = h3zero_find_stream(ctx, 4 * i);
+        if (stream_ctx == NULL || stream_ctx->stream_id != 4 * i || !stream_ctx->is_indexed) {
+            DBG_PRINTF("Stream %" PRIu64 " not found", 4 * i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && ((stream_ctx = h3zero_find_stream(ctx, far_id)) == NULL || stream_ctx->stream_id != far_id ||
+        h3zero_find_stream(ctx, 4 * nb_streams) != NULL)) {
+        DBG_PRINTF("%s", "Stream outside of the index window not found");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        /* Delete streams, including the one that is not indexed, then reuse the contexts */
+        h3zero_delete_stream(NULL, ctx, stream_ctx);
+        for (uint64_t i = 0; i < nb_streams; i += 2) {
+            h3zero_delete_stream(NULL, ctx, h3zero_find_stream(ctx, 4 * i));
+        }
+        if (ctx->nb_streams_not_indexed != 0 || ctx->nb_pooled_stream_ctx != H3ZERO_STREAM_CTX_POOL_MAX ||
+            ctx->h3_stream_tree.size != (int)(nb_streams / 2)) {
+            DBG_PRINTF("%s", "Deleted streams not released as expected");
+            ret = -1;
+        }
+    }
+
+    for (uint64_t i = 0; ret == 0 && i < nb_streams; i++) {
+        stream_ctx = h3zero_find_stream(ctx, 4 * i);
+        if ((stream_ctx == NULL) != ((i & 1) == 0)) {
+            DBG_PRINTF("Stream %" PRIu64 " found after deletion, or deleted by mistake", 4 * i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        stream_ctx = ctx->stream_ctx_pool;
+        if (h3zero_find_or_create_stream(NULL, 4 * nb_streams, ctx, 1, 1) != stream_ctx ||
+            ctx->nb_stream_ctx_reused != 1 || ctx->nb_pooled_stream_ctx != H3ZERO_STREAM_CTX_POOL_MAX - 1 ||
+            stream_ctx->stream_id != 4 * nb_streams || stream_ctx->frame[0] != 0 ||
+            h3zero_find_stream(ctx, 4 * nb_streams) != stream_ctx) {
+            DBG_PRINTF("%s", "Pooled stream context not reused");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = h3zero_stream_index_test_prefix(ctx, far_id);
+    }
+
+    if (ctx != NULL) {
+        h3zero_callback_delete_context(NULL, ctx);
+    }
+
+    return ret;
+}
+
+/* Check that datagrams queued for several stream prefixes are sent by
+ * order of urgency, round robin within the same urgency, and coalesced
+ * in the same packet during a single prepare datagram callback.
+ */
+static int h3zero_datagram_queue_test_one(picoquic_cnx_t* cnx, h3zero_callback_ctx_t* h3_ctx,
+    size_t packet_space, const uint8_t* expected, size_t nb_expected, size_t payload_length)
+{
+    int ret = 0;
+    uint8_t packet[PICOQUIC_MAX_PACKET_SIZE];
+    uint64_t nb_coalesced = h3_ctx->nb_datagram_frames_coalesced;
+    int more_data = 0;
+    int is_pure_ack = 1;
+    const uint8_t* bytes = packet;
+    const uint8_t* bytes_max = picoquic_format_ready_datagram_frame(cnx, cnx->path[0], packet, packet + packet_space,
+        &more_data, &is_pure_ack, &ret);
+    size_t nb_frames = 0;
+
+    while (ret == 0 && bytes != NULL && bytes < bytes_max) {
+        uint64_t frame_type = 0;
+        uint64_t frame_length = 0;
+        uint64_t quarter_stream_id = 0;
+        const uint8_t* payload;
+
+        if ((bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_type)) == NULL ||
+            frame_type != picoquic_frame_type_datagram_l ||
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_length)) == NULL ||
+            bytes + frame_length > bytes_max ||
+            (payload = picoquic_frames_varint_decode(bytes, bytes + frame_length, &quarter_stream_id)) == NULL) {
+            DBG_PRINTF("Cannot parse datagram frame #%zu", nb_frames);
+            ret = -1;
+        }
+        else if (nb_frames >= nb_expected || quarter_stream_id != expected[nb_frames] ||
+            (size_t)(bytes + frame_length - payload) != payload_length || payload[0] != expected[nb_frames]) {
+            DBG_PRINTF("Unexpected datagram #%zu, quarter stream id %" PRIu64, nb_frames, quarter_stream_id);
+            ret = -1;
+        }
+        else {
+            bytes += frame_length;
+            nb_frames++;
+        }
+    }
+
+    if (ret == 0 && (nb_frames != nb_expected || (nb_expected > 0 && is_pure_ack) ||
+        h3_ctx->nb_datagram_frames_coalesced != nb_coalesced + ((nb_expected > 1) ? nb_expected - 1 : 0))) {
+        DBG_PRINTF("Expected %zu datagrams in one callback, got %zu", nb_expected, nb_frames);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int h3zero_datagram_queue_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage server_address;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, "h3", NULL, NULL, NULL, NULL, NULL,
+        simulated_time, &simulated_time, NULL, NULL, 0);
+    picoquic_cnx_t* cnx = NULL;
+    h3zero_callback_ctx_t* h3_ctx = h3zero_callback_create_context(NULL);
+    uint8_t datagram[256];
+    const uint8_t expected_small[] = { 2, 1, 0, 1, 0, 0 };
+    const uint8_t expected_large[] = { 0, 0 };
+
+    memset(datagram, 0, sizeof(datagram));
+    if (quic == NULL || h3_ctx == NULL ||
+        picoquic_store_text_addr(&server_address, "10.0.0.1", 443) != 0 ||
+        (cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&server_address, simulated_time, 0, PICOQUIC_TEST_SNI, "h3", 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_set_callback(cnx, h3zero_callback, h3_ctx);
+        cnx->remote_parameters.max_datagram_frame_size = PICOQUIC_MAX_PACKET_SIZE;
+        for (uint64_t i = 0; ret == 0 && i < 3; i++) {
+            ret = h3zero_declare_stream_prefix(h3_ctx, 4 * i, NULL, NULL);
+        }
+    }
+
+    if (ret == 0 && (h3zero_set_datagram_urgency(cnx, 8, 1) != 0 ||
+        h3zero_set_datagram_urgency(cnx, 4, H3ZERO_PRIORITY_URGENCY_MAX + 1) == 0 ||
+        h3zero_queue_datagram(cnx, 12, datagram, 16) == 0 ||
+        h3zero_queue_datagram(cnx, 0, datagram, PICOQUIC_DATAGRAM_QUEUE_MAX_LENGTH) == 0)) {
+        DBG_PRINTF("%s", "Invalid datagram queue request accepted");
+        ret = -1;
+    }
+
+    /* Small datagrams: three on prefix 0, two on prefix 4, one on the urgent prefix 8 */
+    for (uint64_t i = 0; ret == 0 && i < 3; i++) {
+        for (int j = 0; ret == 0 && j < (int)(3 - i); j++) {
+            datagram[0] = (uint8_t)i;
+            ret = h3zero_queue_datagram(cnx, 4 * i, datagram, 16);
+        }
+    }
+
+    if (ret == 0) {
+        ret = h3zero_datagram_queue_test_one(cnx, h3_ctx, PICOQUIC_MAX_PACKET_SIZE,
+            expected_small, sizeof(expected_small), 16);
+    }
+
+    if (ret == 0 && (h3_ctx->nb_queued_datagrams != 0 || cnx->is_datagram_ready)) {
+        DBG_PRINTF("%s", "Datagram queue not drained");
+        ret = -1;
+    }
+
+    /* Large datagrams only fit two at a time in a small packet */
+    datagram[0] = 0;
+    for (int i = 0; ret == 0 && i < 5; i++) {
+        ret = h3zero_queue_datagram(cnx, 0, datagram, 100);
+    }
+
+    if (ret == 0) {
+        ret = h3zero_datagram_queue_test_one(cnx, h3_ctx, 250, expected_large, sizeof(expected_large), 100);
+    }
+
+    if (ret == 0 && (h3_ctx->nb_queued_datagrams != 3 || !cnx->is_datagram_ready)) {
+        DBG_PRINTF("%s", "Datagrams that do not fit should stay queued");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = h3zero_datagram_queue_test_one(cnx, h3_ctx, 250, expected_large, sizeof(expected_large), 100);
+    }
+
+    /* The last queued datagram is freed with the prefixes */
+    if (h3_ctx != NULL) {
+        h3zero_callback_delete_context(cnx, h3_ctx);
+    }
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Test of the client connection pool: reuse, happy eyeballs race,
+ * coalescing of HTTP/3 authorities, eviction and idle timeout. The
+ * connections do not exchange packets, their state is set directly. */
+static int h3zero_cnx_pool_test_init(picoquic_cnx_t* cnx, void* init_ctx)
+{
+    (void)cnx;
+    (*(int*)init_ctx)++;
+    return 0;
+}
+
+static void h3zero_cnx_pool_test_release(picoquic_cnx_t* cnx, void* init_ctx)
+{
+    (void)cnx;
+    (*(int*)init_ctx)--;
+}
+
+static int h3zero_cnx_pool_test_authority(picoquic_cnx_t* cnx, char const* authority, void* authority_ctx)
+{
+    /* Behave as if the certificate was issued for "*.example.com" */
+    (void)cnx;
+    (void)authority_ctx;
+    return h3zero_cnx_pool_name_matches("*.example.com", authority);
+}
+
+int h3zero_cnx_pool_test()
+{
+    int ret = 0;
+    int nb_cnx = 0;
+    uint64_t simulated_time = 0;
+    uint64_t const idle_timeout = 1000000;
+    uint64_t const race_delay = 50000;
+    struct sockaddr_storage addr_v6;
+    struct sockaddr_storage addr_v4;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, "h3", NULL, NULL, NULL, NULL, NULL,
+        simulated_time, &simulated_time, NULL, NULL, 0);
+    h3zero_cnx_pool_t* pool = NULL;
+    h3zero_pooled_cnx_t* entry[3] = { NULL, NULL, NULL };
+
+    if (quic == NULL ||
+        picoquic_store_text_addr(&addr_v6, "2001:db8::1", 443) != 0 ||
+        picoquic_store_text_addr(&addr_v4, "10.0.0.1", 443) != 0 ||
+        (pool = h3zero_cnx_pool_create(quic, 2, idle_timeout, race_delay)) == NULL) {
+        ret = -1;
+    }
+    else {
+        h3zero_cnx_pool_set_callbacks(pool, h3zero_cnx_pool_test_init, h3zero_cnx_pool_test_release, &nb_cnx);
+        h3zero_cnx_pool_set_authority_check(pool, h3zero_cnx_pool_test_authority, NULL);
+    }
+
+    if (ret == 0 && (!h3zero_cnx_pool_name_matches("*.example.com", "www.example.com") ||
+        h3zero_cnx_pool_name_matches("*.example.com", "example.com") ||
+        h3zero_cnx_pool_name_matches("*.example.com", "a.b.example.com") ||
+        !h3zero_cnx_pool_name_matches("WWW.Example.com", "www.example.COM") ||
+        h3zero_cnx_pool_name_matches("www.example.com", "www.example.co"))) {
+        DBG_PRINTF("%s", "Name matching fails");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        /* The second request for the same origin reuses the connection */
+        entry[0] = h3zero_cnx_pool_get(pool, "www.example.com", "h3", (struct sockaddr*)&addr_v6,
+            (struct sockaddr*)&addr_v4, simulated_time);
+        if (entry[0] == NULL || h3zero_pooled_cnx_is_ready(entry[0]) ||
+            h3zero_cnx_pool_get(pool, "www.example.com", "h3", (struct sockaddr*)&addr_v6,
+                (struct sockaddr*)&addr_v4, simulated_time) != entry[0] ||
+            pool->nb_created != 1 || pool->nb_reused != 1 || nb_cnx != 1) {
+            DBG_PRINTF("%s", "Connection not reused");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* The IPv4 connection starts after the race delay, and wins */
+        if (h3zero_cnx_pool_housekeeping(pool, simulated_time) != race_delay) {
+            DBG_PRINTF("%s", "Race not scheduled");
+            ret = -1;
+        }
+        else {
+            simulated_time += race_delay;
+            (void)h3zero_cnx_pool_housekeeping(pool, simulated_time);
+            if (entry[0]->racing_cnx == NULL || pool->nb_races != 1 || nb_cnx != 2) {
+                DBG_PRINTF("%s", "Race not started");
+                ret = -1;
+            }
+            else {
+                picoquic_cnx_t* racing_cnx = entry[0]->racing_cnx;
+
+                racing_cnx->cnx_state = picoquic_state_ready;
+                (void)h3zero_cnx_pool_housekeeping(pool, simulated_time);
+                if (entry[0]->cnx != racing_cnx || entry[0]->racing_cnx != NULL || entry[0]->retired_cnx == NULL ||
+                    pool->nb_alternate_wins != 1 || !h3zero_pooled_cnx_is_ready(entry[0])) {
+                    DBG_PRINTF("%s", "Race winner not selected");
+                    ret = -1;
+                }
+                else {
+                    entry[0]->retired_cnx->cnx_state = picoquic_state_disconnected;
+                    (void)h3zero_cnx_pool_housekeeping(pool, simulated_time);
+                    if (entry[0]->retired_cnx != NULL || nb_cnx != 1) {
+                        DBG_PRINTF("%s", "Race loser not deleted");
+                        ret = -1;
+                    }
+                }
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Authorities covered by the certificate share the connection, others do not */
+        if (h3zero_cnx_pool_get(pool, "api.example.com", "h3", (struct sockaddr*)&addr_v4, NULL,
+            simulated_time) != entry[0] || pool->nb_coalesced != 1) {
+            DBG_PRINTF("%s", "Covered authority not coalesced");
+            ret = -1;
+        }
+        else if ((entry[1] = h3zero_cnx_pool_get(pool, "www.example.net", "h3", (struct sockaddr*)&addr_v4, NULL,
+            simulated_time)) == NULL || entry[1] == entry[0] || pool->nb_coalesced != 1 || nb_cnx != 2) {
+            DBG_PRINTF("%s", "Other authority coalesced");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Only HTTP/3 connections are coalesced. The pool is full, the least
+         * recently used connection is closed. */
+        simulated_time += 1000;
+        entry[2] = h3zero_cnx_pool_get(pool, "api.example.com", "hq-interop", (struct sockaddr*)&addr_v4, NULL,
+            simulated_time);
+        if (entry[2] == NULL || entry[2] == entry[0] || pool->nb_entries != 2 ||
+            !entry[0]->is_closing || entry[1]->is_closing || nb_cnx != 3) {
+            DBG_PRINTF("%s", "Least recently used connection not closed");
+            ret = -1;
+        }
+        else {
+            entry[0]->cnx->cnx_state = picoquic_state_disconnected;
+            (void)h3zero_cnx_pool_housekeeping(pool, simulated_time);
+            if (pool->last != entry[1] || nb_cnx != 2) {
+                DBG_PRINTF("%s", "Closed connection not removed");
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Established connections are closed after the idle timeout */
+        entry[1]->cnx->cnx_state = picoquic_state_ready;
+        if (h3zero_cnx_pool_housekeeping(pool, simulated_time) != simulated_time - 1000 + idle_timeout ||
+            entry[1]->is_closing) {
+            DBG_PRINTF("%s", "Idle timeout not scheduled");
+            ret = -1;
+        }
+        else {
+            simulated_time += idle_timeout;
+            (void)h3zero_cnx_pool_housekeeping(pool, simulated_time);
+            if (!entry[1]->is_closing || pool->nb_entries != 1) {
+                DBG_PRINTF("%s", "Idle connection not closed");
+                ret = -1;
+            }
+        }
+    }
+
+    if (pool != NULL) {
+        h3zero_cnx_pool_delete(pool);
+        if (ret == 0 && nb_cnx != 0) {
+            DBG_PRINTF("%d connections not released", nb_cnx);
+            ret = -1;
+        }
+    }
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Test of the CONNECT-UDP proxy: parsing of the target, rate limiter, and
+ * forwarding of payloads in both directions between the HTTP datagrams and
+ * a UDP target on the loopback address. */
+typedef struct st_connect_udp_path_test_case_t {
+    char const* path;
+    char const* expected_addr;
+    uint16_t expected_port;
+} connect_udp_path_test_case_t;
+
+static const connect_udp_path_test_case_t connect_udp_path_test_case[] = {
+    { CONNECT_UDP_PATH "192.0.2.6/443/", "192.0.2.6", 443 },
+    { CONNECT_UDP_PATH "192.0.2.6/53", "192.0.2.6", 53 },
+    { CONNECT_UDP_PATH "192.0.2.6/4443?x=1", "192.0.2.6", 4443 },
+    { CONNECT_UDP_PATH "2001%3Adb8%3A%3A42/65535/", "2001:db8::42", 65535 },
+    { CONNECT_UDP_PATH "2001%3adb8%3a%3a42/8/", "2001:db8::42", 8 },
+    { CONNECT_UDP_PATH "192.0.2.6/0/", NULL, 0 },
+    { CONNECT_UDP_PATH "192.0.2.6/65536/", NULL, 0 },
+    { CONNECT_UDP_PATH "192.0.2.6/443x/", NULL, 0 },
+    { CONNECT_UDP_PATH "192.0.2.6//", NULL, 0 },
+    { CONNECT_UDP_PATH "192.0.2.6", NULL, 0 },
+    { CONNECT_UDP_PATH "/443/", NULL, 0 },
+    { CONNECT_UDP_PATH "example.com/443/", NULL, 0 },
+    { CONNECT_UDP_PATH "2001%3Bdb8%3A%3A42/443/", NULL, 0 },
+    { "/.well-known/masque/ip/192.0.2.6/443/", NULL, 0 }
+};
+
+static int connect_udp_path_test()
+{
+    int ret = 0;
+    const size_t nb_cases = sizeof(connect_udp_path_test_case) / sizeof(connect_udp_path_test_case_t);
+
+    for (size_t i = 0; ret == 0 && i < nb_cases; i++) {
+        struct sockaddr_storage target;
+        struct sockaddr_storage expected;
+        const connect_udp_path_test_case_t* test = &connect_udp_path_test_case[i];
+        int parse_ret = connect_udp_parse_path((const uint8_t*)test->path, strlen(test->path), &target);
+
+        if (test->expected_addr == NULL) {
+            if (parse_ret == 0) {
+                DBG_PRINTF("Invalid path accepted: %s", test->path);
+                ret = -1;
+            }
+        }
+        else if (parse_ret != 0 ||
+            picoquic_store_text_addr(&expected, test->expected_addr, htons(test->expected_port)) != 0 ||
+            picoquic_compare_addr((struct sockaddr*)&target, (struct sockaddr*)&expected) != 0) {
+            DBG_PRINTF("Cannot parse path: %s", test->path);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int connect_udp_rate_test()
+{
+    int ret = 0;
+    connect_udp_rate_t rate_ctx = { 1000, 500, 500, 0 };
+    connect_udp_rate_t no_limit = { 0, 0, 0, 0 };
+
+    if (!connect_udp_rate_check(&rate_ctx, 400, 0) ||
+        connect_udp_rate_check(&rate_ctx, 200, 0) ||
+        !connect_udp_rate_check(&rate_ctx, 200, 200000) ||
+        rate_ctx.tokens != 100 ||
+        connect_udp_rate_check(&rate_ctx, 200, 200500) ||
+        !connect_udp_rate_check(&rate_ctx, 500, 2000000) ||
+        !connect_udp_rate_check(&no_limit, 100000, 0)) {
+        DBG_PRINTF("%s", "Unexpected rate limiter decision");
+        ret = -1;
+    }
+    return ret;
+}
+
+static int connect_udp_test_wait(SOCKET_TYPE fd)
+{
+    fd_set readfds;
+    struct timeval tv;
+
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+
+    return (select((int)(fd + 1), &readfds, NULL, NULL, &tv) > 0) ? 0 : -1;
+}
+
+static int connect_udp_forward_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_storage server_address;
+    struct sockaddr_storage target_address;
+    struct sockaddr_storage flow_address;
+    socklen_t addr_length = sizeof(struct sockaddr_storage);
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, "h3", NULL, NULL, NULL, NULL, NULL,
+        simulated_time, &simulated_time, NULL, NULL, 0);
+    picoquic_cnx_t* cnx = NULL;
+    h3zero_callback_ctx_t* h3_ctx = h3zero_callback_create_context(NULL);
+    connect_udp_proxy_t* proxy = connect_udp_proxy_create(1, 0, 0);
+    h3zero_stream_ctx_t* stream_ctx = NULL;
+    connect_udp_flow_t* flow = NULL;
+    SOCKET_TYPE target_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    char path[128];
+    uint8_t datagram[64];
+    uint8_t packet[PICOQUIC_MAX_PACKET_SIZE];
+    const uint8_t request[] = { CONNECT_UDP_CONTEXT_ID_PAYLOAD, 'h', 'e', 'l', 'l', 'o' };
+    const uint8_t response[] = { 'w', 'o', 'r', 'l', 'd' };
+
+    if (quic == NULL || h3_ctx == NULL || proxy == NULL || target_fd == INVALID_SOCKET ||
+        picoquic_store_text_addr(&target_address, "127.0.0.1", 0) != 0 ||
+        bind(target_fd, (struct sockaddr*)&target_address, picoquic_addr_length((struct sockaddr*)&target_address)) != 0 ||
+        getsockname(target_fd, (struct sockaddr*)&target_address, &addr_length) != 0 ||
+        picoquic_store_text_addr(&server_address, "10.0.0.1", 443) != 0 ||
+        (cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&server_address, simulated_time, 0, PICOQUIC_TEST_SNI, "h3", 1)) == NULL ||
+        (stream_ctx = h3zero_find_or_create_stream(cnx, 4, h3_ctx, 1, 1)) == NULL) {
+        ret = -1;
+    }
+    else {
+        size_t path_length = 0;
+
+        picoquic_set_callback(cnx, h3zero_callback, h3_ctx);
+        cnx->remote_parameters.max_datagram_frame_size = PICOQUIC_MAX_PACKET_SIZE;
+        (void)picoquic_sprintf(path, sizeof(path), &path_length, "%s127.0.0.1/%d/", CONNECT_UDP_PATH,
+            ntohs(((struct sockaddr_in*)&target_address)->sin_port));
+        stream_ctx->ps.stream_state.header.protocol = (const uint8_t*)CONNECT_UDP_PROTOCOL;
+        stream_ctx->ps.stream_state.header.protocol_length = strlen(CONNECT_UDP_PROTOCOL);
+
+        /* The wrong protocol is refused before the flow is created */
+        stream_ctx->ps.stream_state.header.protocol_length--;
+        if (connect_udp_callback(cnx, (uint8_t*)path, path_length, picohttp_callback_connect, stream_ctx, proxy) == 0) {
+            DBG_PRINTF("%s", "Unexpected protocol accepted");
+            ret = -1;
+        }
+        stream_ctx->ps.stream_state.header.protocol_length++;
+
+        if (ret == 0 && (connect_udp_callback(cnx, (uint8_t*)path, path_length, picohttp_callback_connect, stream_ctx, proxy) != 0 ||
+            proxy->nb_flows != 1 || (flow = (connect_udp_flow_t*)stream_ctx->path_callback_ctx) == NULL)) {
+            DBG_PRINTF("%s", "Cannot accept the connect request");
+            ret = -1;
+        }
+        /* The second flow exceeds the proxy limit */
+        if (ret == 0) {
+            h3zero_stream_ctx_t* second_ctx = h3zero_find_or_create_stream(cnx, 8, h3_ctx, 1, 1);
+
+            if (second_ctx == NULL) {
+                ret = -1;
+            }
+            else {
+                second_ctx->ps.stream_state.header.protocol = stream_ctx->ps.stream_state.header.protocol;
+                second_ctx->ps.stream_state.header.protocol_length = stream_ctx->ps.stream_state.header.protocol_length;
+                if (connect_udp_callback(cnx, (uint8_t*)path, path_length, picohttp_callback_connect, second_ctx, proxy) == 0 ||
+                    proxy->nb_flows_refused != 1) {
+                    DBG_PRINTF("%s", "Flow limit not enforced");
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    /* Client to target, as HTTP datagram. Datagrams with another context ID are dropped. */
+    if (ret == 0) {
+        datagram[0] = 1;
+        if (connect_udp_callback(cnx, datagram, 6, picohttp_callback_post_datagram, stream_ctx, flow) != 0 ||
+            connect_udp_callback(cnx, (uint8_t*)request, sizeof(request), picohttp_callback_post_datagram, stream_ctx, flow) != 0 ||
+            connect_udp_test_wait(target_fd) != 0 ||
+            recvfrom(target_fd, (char*)datagram, sizeof(datagram), 0, (struct sockaddr*)&flow_address, &addr_length) != sizeof(request) - 1 ||
+            memcmp(datagram, request + 1, sizeof(request) - 1) != 0 ||
+            flow->nb_sent_to_target != 1 || flow->nb_dropped != 1) {
+            DBG_PRINTF("%s", "Datagram not forwarded to target");
+            ret = -1;
+        }
+    }
+
+    /* Target to client, polled and sent in a datagram frame after the quarter stream ID */
+    if (ret == 0) {
+        int more_data = 0;
+        int is_pure_ack = 1;
+        const uint8_t* bytes = packet;
+        const uint8_t* bytes_max;
+        uint64_t frame_type = 0;
+        uint64_t frame_length = 0;
+        uint64_t quarter_stream_id = 0;
+        uint64_t context_id = 0;
+
+        addr_length = picoquic_addr_length((struct sockaddr*)&flow_address);
+        if (sendto(target_fd, (const char*)response, (int)sizeof(response), 0, (struct sockaddr*)&flow_address, addr_length) != sizeof(response) ||
+            connect_udp_test_wait(flow->fd) != 0 ||
+            connect_udp_proxy_poll(proxy, simulated_time) != 1 || flow->ring_count != 1) {
+            DBG_PRINTF("%s", "Response not received from target");
+            ret = -1;
+        }
+        else if ((bytes_max = picoquic_format_ready_datagram_frame(cnx, cnx->path[0], packet, packet + sizeof(packet),
+            &more_data, &is_pure_ack, &ret)) == NULL || ret != 0 ||
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_type)) == NULL ||
+            frame_type != picoquic_frame_type_datagram_l ||
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &frame_length)) == NULL ||
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &quarter_stream_id)) == NULL ||
+            (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &context_id)) == NULL ||
+            quarter_stream_id != 1 || context_id != CONNECT_UDP_CONTEXT_ID_PAYLOAD ||
+            bytes + sizeof(response) != bytes_max || memcmp(bytes, response, sizeof(response)) != 0 ||
+            flow->ring_count != 0 || flow->nb_sent_to_client != 1) {
+            DBG_PRINTF("%s", "Response not forwarded to client");
+            ret = -1;
+        }
+    }
+
+    /* The FIN of the request stream closes the flow */
+    if (ret == 0 && (connect_udp_callback(cnx, NULL, 0, picohttp_callback_post_fin, stream_ctx, flow) != 0 ||
+        proxy->nb_flows != 0 || stream_ctx->path_callback_ctx != NULL ||
+        h3zero_find_stream_prefix(h3_ctx, 4) != NULL)) {
+        DBG_PRINTF("%s", "Flow not closed by FIN");
+        ret = -1;
+    }
+
+    if (target_fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(target_fd);
+    }
+    if (h3_ctx != NULL) {
+        h3zero_callback_delete_context(cnx, h3_ctx);
+    }
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+    connect_udp_proxy_delete(proxy);
+
+    return ret;
+}
+
+int connect_udp_test()
+{
+    int ret = connect_udp_path_test();
+
+    if (ret == 0) {
+        ret = connect_udp_rate_test();
+    }
+    if (ret == 0) {
+        ret = connect_udp_forward_test();
+    }
+    return ret;
+}
+
+/* Test of the path router: exact items match the path with or without
+ * query string, prefix items match the paths that start with them, and
+ * the router finds the same items as the scan of the table. */
+static char* h3zero_path_router_test_paths[] = {
+    "/", "/post", "/baton", "/api/", "/api/v1/", "/api/v1/users", "/api/v1/users",
+    "/api/v2", "/static/", "/static/img/", "/a", "/ab", "/abc", "/api/v1/users/me"
+};
+
+static const int h3zero_path_router_test_prefix[] = {
+    0, 0, 0, 1, 1, 0, 0, 0, 1, 1, 0, 1, 0, 0
+};
+
+typedef struct st_h3zero_path_router_test_case_t {
+    char const* path;
+    int expected;
+} h3zero_path_router_test_case_t;
+
+static const h3zero_path_router_test_case_t h3zero_path_router_test_case[] = {
+    { "/", 0 },
+    { "/?x=1", 0 },
+    { "/post", 1 },
+    { "/post?a", 1 },
+    { "/posts", -1 },
+    { "/api", -1 },
+    { "/api/", 3 },
+    { "/api/v3", 3 },
+    { "/api/v1/", 4 },
+    { "/api/v1/users", 5 },
+    { "/api/v1/users?id=3", 5 },
+    { "/api/v1/users/me", 13 },
+    { "/api/v1/users/you", 4 },
+    { "/api/v2", 7 },
+    { "/api/v2/x", 3 },
+    { "/static/img/logo.png", 9 },
+    { "/static/css/site.css", 8 },
+    { "/ab", 11 },
+    { "/abc", 12 },
+    { "/abcd", 11 },
+    { "/a", 10 },
+    { "", -1 }
+};
+
+int h3zero_path_router_test()
+{
+    int ret = 0;
+    const size_t nb_items = sizeof(h3zero_path_router_test_paths) / sizeof(char*);
+    const size_t nb_cases = sizeof(h3zero_path_router_test_case) / sizeof(h3zero_path_router_test_case_t);
+    picohttp_server_path_item_t path_table[sizeof(h3zero_path_router_test_paths) / sizeof(char*)];
+    h3zero_path_router_t* router = NULL;
+    uint64_t random_context = 0xa1b2c3d4e5f60718ull;
+
+    memset(path_table, 0, sizeof(path_table));
+    for (size_t i = 0; i < nb_items; i++) {
+        path_table[i].path = h3zero_path_router_test_paths[i];
+        path_table[i].path_length = strlen(h3zero_path_router_test_paths[i]);
+        path_table[i].is_prefix = h3zero_path_router_test_prefix[i];
+    }
+
+    if ((router = h3zero_path_router_create(path_table, nb_items)) == NULL) {
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_cases; i++) {
+        const uint8_t* path = (const uint8_t*)h3zero_path_router_test_case[i].path;
+        size_t path_length = strlen(h3zero_path_router_test_case[i].path);
+        int found = h3zero_path_router_find(router, path, path_length);
+        int scanned = h3zero_find_path_item(path, path_length, path_table, nb_items);
+
+        if (found != h3zero_path_router_test_case[i].expected || scanned != found) {
+            DBG_PRINTF("Path <%s>, expected %d, router %d, scan %d", h3zero_path_router_test_case[i].path,
+                h3zero_path_router_test_case[i].expected, found, scanned);
+            ret = -1;
+        }
+    }
+
+    /* Random paths built from pieces of the item paths */
+    for (int i = 0; ret == 0 && i < 10000; i++) {
+        char path[256];
+        size_t path_length = 0;
+        int nb_pieces = 1 + (int)picoquic_test_uniform_random(&random_context, 3);
+
+        for (int j = 0; j < nb_pieces; j++) {
+            char const* piece = h3zero_path_router_test_paths[picoquic_test_uniform_random(&random_context, nb_items)];
+            size_t piece_length = (size_t)picoquic_test_uniform_random(&random_context, strlen(piece) + 1);
+
+            memcpy(path + path_length, piece, piece_length);
+            path_length += piece_length;
+        }
+        if (picoquic_test_uniform_random(&random_context, 4) == 0) {
+            path[path_length++] = '?';
+        }
+        if (h3zero_path_router_find(router, (uint8_t*)path, path_length) !=
+            h3zero_find_path_item((uint8_t*)path, path_length, path_table, nb_items)) {
+            DBG_PRINTF("Router and scan differ for path <%.*s>", (int)path_length, path);
+            ret = -1;
+        }
+    }
+
+    h3zero_path_router_delete(router);
+
+    return ret;
+}
+
+/* Test of the response cache: responses are shared, dates and entity tags
+ * are formatted as expected, conditional requests are recognized, the
+ * memory is capped, and changed files are detected after the revalidation
+ * interval. */
+static int h3zero_response_cache_test_dates()
+{
+    int ret = 0;
+    const struct {
+        int64_t seconds;
+        char const* date;
+    } dates[] = {
+        { 0, "Thu, 01 Jan 1970 00:00:00 GMT" },
+        { 784111777, "Sun, 06 Nov 1994 08:49:37 GMT" },
+        { 951782400, "Tue, 29 Feb 2000 00:00:00 GMT" },
+        { 1735689599, "Tue, 31 Dec 2024 23:59:59 GMT" }
+    };
+
+    for (size_t i = 0; ret == 0 && i < sizeof(dates) / sizeof(dates[0]); i++) {
+        char buf[H3ZERO_RESPONSE_DATE_MAX];
+
+        if (h3zero_response_format_date(buf, sizeof(buf), dates[i].seconds) != 0 ||
+            strcmp(buf, dates[i].date) != 0) {
+            DBG_PRINTF("Date %" PRId64 " formatted as %s instead of %s", dates[i].seconds, buf, dates[i].date);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int h3zero_response_cache_test_conditional(h3zero_response_cache_t* cache, h3zero_cached_response_t* response)
+{
+    int ret = 0;
+    char weak[H3ZERO_RESPONSE_ETAG_MAX + 16];
+    size_t len = 0;
+    h3zero_header_parts_t parts;
+
+    memset(&parts, 0, sizeof(parts));
+    if (h3zero_response_cache_is_not_modified(cache, response, &parts)) {
+        ret = -1;
+    }
+    parts.if_none_match = (uint8_t const*)response->etag;
+    parts.if_none_match_length = strlen(response->etag);
+    if (ret == 0 && !h3zero_response_cache_is_not_modified(cache, response, &parts)) {
+        ret = -1;
+    }
+    if (ret == 0 && (ret = picoquic_sprintf(weak, sizeof(weak), &len, "\"x\", W/%s", response->etag)) == 0) {
+        parts.if_none_match = (uint8_t const*)weak;
+        parts.if_none_match_length = len;
+        if (!h3zero_response_cache_is_not_modified(cache, response, &parts)) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        /* If-Modified-Since does not apply if the entity tags do not match */
+        parts.if_none_match = (uint8_t const*)"\"x\"";
+        parts.if_none_match_length = 3;
+        parts.if_modified_since = (uint8_t const*)response->last_modified;
+        parts.if_modified_since_length = strlen(response->last_modified);
+        if (h3zero_response_cache_is_not_modified(cache, response, &parts)) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        parts.if_none_match = NULL;
+        parts.if_none_match_length = 0;
+        if (!h3zero_response_cache_is_not_modified(cache, response, &parts) || cache->nb_not_modified != 3) {
+            ret = -1;
+        }
+    }
+    if (ret != 0) {
+        DBG_PRINTF("Conditional request not checked as expected, etag %s", response->etag);
+    }
+
+    return ret;
+}
+
+static int h3zero_response_cache_test_sections(h3zero_cached_response_t* response)
+{
+    int ret = 0;
+    h3zero_header_parts_t parts;
+    uint8_t* bytes;
+
+    memset(&parts, 0, sizeof(parts));
+    bytes = h3zero_parse_qpack_header_frame(response->header_section,
+        response->header_section + response->header_length, &parts);
+    if (bytes == NULL || parts.status != 200 || parts.content_type != h3zero_content_type_text_plain) {
+        ret = -1;
+    }
+    h3zero_release_header_parts(&parts);
+    memset(&parts, 0, sizeof(parts));
+    bytes = h3zero_parse_qpack_header_frame(response->not_modified_section,
+        response->not_modified_section + response->not_modified_length, &parts);
+    if (bytes == NULL || parts.status != 304 || parts.content_type != h3zero_content_type_none) {
+        ret = -1;
+    }
+    h3zero_release_header_parts(&parts);
+    if (ret != 0) {
+        DBG_PRINTF("%s", "Cached header sections cannot be parsed");
+    }
+    else {
+        /* The conditional headers of requests are kept by the parser */
+        uint8_t conditional[] = { 0, 0, 0x59, 3, '"', 'x', '"', 0x58, 3, 'a', 'b', 'c' };
+
+        memset(&parts, 0, sizeof(parts));
+        bytes = h3zero_parse_qpack_header_frame(conditional, conditional + sizeof(conditional), &parts);
+        if (bytes == NULL || parts.if_none_match_length != 3 || memcmp(parts.if_none_match, "\"x\"", 3) != 0 ||
+            parts.if_modified_since_length != 3 || memcmp(parts.if_modified_since, "abc", 3) != 0) {
+            DBG_PRINTF("%s", "Conditional headers are not parsed");
+            ret = -1;
+        }
+        h3zero_release_header_parts(&parts);
+    }
+
+    return ret;
+}
+
+int h3zero_response_cache_test()
+{
+    int ret = 0;
+    char const* file_path[3] = { "h3zero_response_cache_test_1.txt", "h3zero_response_cache_test_2.txt",
+        "h3zero_response_cache_test_3.txt" };
+    char const* url_path[3] = { "/test_1.txt", "/test_2.txt", "/test_3.txt" };
+    h3zero_cached_response_t* response[3] = { NULL, NULL, NULL };
+    h3zero_response_body_t* body = NULL;
+    uint64_t current_time = 0;
+    uint64_t const revalidate_interval = 1000000;
+    /* Enough memory for two entries, but not three */
+    size_t const max_memory = 2 * (sizeof(h3zero_cached_response_t) + sizeof(h3zero_response_body_t) + 1000 + 128);
+    h3zero_response_cache_t* cache = h3zero_response_cache_create(max_memory, 0, revalidate_interval);
+
+    if (cache == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = h3zero_response_cache_test_dates();
+    }
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        ret = h3zero_file_cache_test_write(file_path[i], 1000);
+    }
+
+    if (ret == 0) {
+        /* The response is loaded once, then found in the cache */
+        response[0] = h3zero_response_cache_add(cache, (uint8_t const*)url_path[0], strlen(url_path[0]),
+            file_path[0], h3zero_content_type_text_plain, current_time);
+        if (response[0] == NULL || response[0]->body->length != 1000 ||
+            h3zero_response_cache_get(cache, (uint8_t const*)url_path[0], strlen(url_path[0]), current_time) != response[0] ||
+            h3zero_response_cache_get(cache, (uint8_t const*)url_path[1], strlen(url_path[1]), current_time) != NULL ||
+            cache->nb_misses != 1 || cache->nb_hits != 1) {
+            DBG_PRINTF("%s", "Response is not found in the cache");
+            ret = -1;
+        }
+        else if (response[0]->body->data[0] != 'a' || response[0]->body->data[999] != 'a' + (999 % 26)) {
+            DBG_PRINTF("%s", "Cached body does not match the file");
+            ret = -1;
+        }
+        else if ((ret = h3zero_response_cache_test_sections(response[0])) == 0) {
+            ret = h3zero_response_cache_test_conditional(cache, response[0]);
+        }
+    }
+
+    if (ret == 0) {
+        /* The least recently used response is evicted, but its body stays valid while referenced */
+        body = h3zero_response_body_reference(response[0]->body);
+        for (int i = 1; ret == 0 && i < 3; i++) {
+            current_time += 1000;
+            response[i] = h3zero_response_cache_add(cache, (uint8_t const*)url_path[i], strlen(url_path[i]),
+                file_path[i], h3zero_content_type_text_plain, current_time);
+            if (response[i] == NULL) {
+                ret = -1;
+            }
+        }
+        if (ret != 0 || cache->nb_responses != 2 || cache->memory_used > max_memory ||
+            h3zero_response_cache_get(cache, (uint8_t const*)url_path[0], strlen(url_path[0]), current_time) != NULL ||
+            body->ref_count != 1 || body->length != 1000 || body->data[0] != 'a') {
+            DBG_PRINTF("%s", "Least recently used response not evicted");
+            ret = -1;
+        }
+        h3zero_response_body_release(body);
+    }
+
+    if (ret == 0 && (ret = h3zero_file_cache_test_write(file_path[2], 2000)) == 0) {
+        /* The change is only seen after the revalidation interval */
+        if (h3zero_response_cache_get(cache, (uint8_t const*)url_path[2], strlen(url_path[2]),
+            current_time + revalidate_interval - 1) != response[2]) {
+            ret = -1;
+        }
+        else if (h3zero_response_cache_get(cache, (uint8_t const*)url_path[2], strlen(url_path[2]),
+            current_time + revalidate_interval) != NULL || cache->nb_responses != 1) {
+            DBG_PRINTF("%s", "Changed file not detected");
+            ret = -1;
+        }
+    }
+
+    h3zero_response_cache_delete(cache);
+    for (int i = 0; i < 3; i++) {
+        (void)remove(file_path[i]);
+    }
+
+    return ret;
+}
+
+/* Serve the file test scenario from the response cache */
+int h3zero_response_cache_serve_test()
+{
+    int ret = 0;
+    char file_name_buffer[1024];
+    picohttp_server_parameters_t file_param;
+
+    ret = serve_file_test_set_param(&file_param, file_name_buffer, sizeof(file_name_buffer));
+
+    if (ret == 0 && (file_param.response_cache = h3zero_response_cache_create(0, 0, 0)) == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0 && (ret = demo_server_test(PICOHTTP_ALPN_H3_LATEST, h3zero_callback, (void*)&file_param,
+        file_test_scenario, nb_file_test_scenario, demo_file_test_stream_length, 0, 0, 0, 0, NULL, NULL, NULL, 0)) != 0) {
+        DBG_PRINTF("H3 server (%s) response cache test fails, ret = %d\n", PICOHTTP_ALPN_H3_LATEST, ret);
+    }
+    else if (ret == 0) {
+        ret = file_test_compare(&file_param, &file_test_scenario[0]);
+        if (ret == 0 && (file_param.response_cache->nb_misses != 1 || file_param.response_cache->first == NULL ||
+            file_param.response_cache->first->body->ref_count != 1)) {
+            DBG_PRINTF("%s", "File was not served from the response cache");
+            ret = -1;
+        }
+    }
+
+    h3zero_response_cache_delete(file_param.response_cache);
+
+    return ret;
+}
+
 static const picoquic_demo_stream_desc_t satellite_test_scenario[] = {
     { 0, 0, PICOQUIC_DEMO_STREAM_ID_INITIAL, "/10000000", "bin10M.txt", 0 }
 };
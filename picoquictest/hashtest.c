@@ -79,6 +79,9 @@ int picohash_test_one(int embedded_item)
     if (!embedded_item) {
         t = picohash_create(32, hashtest_hash, hashtest_compare);
     }
+    else if (embedded_item == 2) {
+        t = picohash_create_open(32, hashtest_hash, hashtest_compare, hashtest_key_to_item, hash_seed);
+    }
     else {
         t = picohash_create_ex(32, hashtest_hash, hashtest_compare, hashtest_key_to_item, hash_seed);
     }
@@ -204,6 +207,76 @@ int picohash_embedded_test()
     return(picohash_test_one(1));
 }
 
+/* Test of the open addressing table. In addition to the basic test, insert
+ * enough entries to force the table to grow several times, with runs of
+ * consecutive hashes, then delete half of them and verify that the
+ * remaining entries are still found after the backward shifts.
+ */
+#define PICOHASH_OPEN_TEST_NB_KEYS 2000
+
+int picohash_open_test()
+{
+    int ret = picohash_test_one(2);
+    picohash_table* t = NULL;
+
+    if (ret == 0 &&
+        (t = picohash_create_open(16, hashtest_hash, hashtest_compare, hashtest_key_to_item, NULL)) == NULL) {
+        DBG_PRINTF("%s", "picohash_create_open() failed\n");
+        ret = -1;
+    }
+
+    if (t != NULL) {
+        struct hashtestkey hk;
+
+        for (uint64_t i = 0; ret == 0 && i < PICOHASH_OPEN_TEST_NB_KEYS; i++) {
+            /* Mix runs of consecutive values and values far apart */
+            uint64_t x = (i & 1) ? i : i * 1024;
+            if (picohash_insert(t, hashtest_item(x)) != 0) {
+                DBG_PRINTF("picohash_insert(%"PRIu64") failed\n", x);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && (t->count != PICOHASH_OPEN_TEST_NB_KEYS || t->nb_bin * 7 < t->count * 8)) {
+            DBG_PRINTF("picohash open table count = %"PRIst", size = %"PRIst"\n", t->count, t->nb_bin);
+            ret = -1;
+        }
+
+        for (uint64_t i = 0; ret == 0 && i < PICOHASH_OPEN_TEST_NB_KEYS; i += 3) {
+            picohash_item* pi;
+            hk.x = (i & 1) ? i : i * 1024;
+            pi = picohash_retrieve(t, &hk);
+            if (pi == NULL || ((struct hashtestkey*)pi->key)->x != hk.x) {
+                DBG_PRINTF("picohash_retrieve(%"PRIu64") failed\n", hk.x);
+                ret = -1;
+            }
+            else {
+                picohash_delete_item(t, pi, 1);
+            }
+        }
+
+        for (uint64_t i = 0; ret == 0 && i < PICOHASH_OPEN_TEST_NB_KEYS; i++) {
+            picohash_item* pi;
+            hk.x = (i & 1) ? i : i * 1024;
+            pi = picohash_retrieve(t, &hk);
+            if ((i % 3) == 0) {
+                if (pi != NULL) {
+                    DBG_PRINTF("picohash_retrieve(%"PRIu64") deleted value still found\n", hk.x);
+                    ret = -1;
+                }
+            }
+            else if (pi == NULL || ((struct hashtestkey*)pi->key)->x != hk.x) {
+                DBG_PRINTF("picohash_retrieve(%"PRIu64") failed after deletions\n", hk.x);
+                ret = -1;
+            }
+        }
+
+        picohash_delete(t, 1);
+    }
+
+    return ret;
+}
+
 /* Test the behavior of the basic hash
  */
 void hash_test_init(uint8_t* test, size_t length, uint8_t * k, size_t k_length)
@@ -333,3 +406,75 @@ int siphash_test()
 #endif /* COMPARING TIMES */
     return ret;
 }
+
+int siphash13_test()
+{
+    uint8_t test[1024];
+    uint8_t k[16];
+    size_t test_lengths[12] = { 1, 3, 7, 8, 12, 16, 17, 31, 127, 257, 515, 1024 };
+    uint64_t href[12] = {
+        0xdb1e9516ca5a804a,
+        0x821479478876f083,
+        0xed1c7f07fc0ae1be,
+        0x6a4ed77878e529b6,
+        0x1660b1ece9663a12,
+        0x35b477d413475e14,
+        0xd934d44453af22a7,
+        0x9d203bd158d8fa82,
+        0x8098b574bf2dc7be,
+        0x225118621d1569e6,
+        0x9fdd721d92278ff1,
+        0x8869eb7aa5bb2277
+    };
+    int ret = 0;
+
+    hash_test_init(test, sizeof(test), k, sizeof(k));
+    /* Check the reference siphash 1-3 values */
+    for (size_t i = 0; i < sizeof(test_lengths) / sizeof(size_t); i++) {
+        uint64_t h = picohash_siphash13(test, test_lengths[i], k);
+        if (h != href[i]) {
+            DBG_PRINTF("H13[%zu] = %" PRIx64 " instead of %"PRIx64, i, h, href[i]);
+            ret = -1;
+            break;
+        }
+    }
+    /* The fixed length variants must match the generic code at any alignment */
+    for (size_t offset = 0; ret == 0 && offset < 8; offset++) {
+        if (picohash_siphash13_6(test + offset, k) != picohash_siphash13(test + offset, 6, k)) {
+            DBG_PRINTF("Siphash13_6 mismatch at offset %zu", offset);
+            ret = -1;
+        }
+        else if (picohash_siphash13_18(test + offset, k) != picohash_siphash13(test + offset, 18, k)) {
+            DBG_PRINTF("Siphash13_18 mismatch at offset %zu", offset);
+            ret = -1;
+        }
+    }
+    /* The address table keeps SipHash-2-4 unless the context selects 1-3 */
+    if (ret == 0) {
+        picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL,
+            NULL, NULL, NULL, 0, NULL, NULL, NULL, 0);
+        picoquic_path_t path_x;
+
+        memset(&path_x, 0, sizeof(path_x));
+        if (quic == NULL || picoquic_store_text_addr(&path_x.registered_peer_addr, "10.0.0.2", 4433) != 0) {
+            DBG_PRINTF("%s", "Cannot create the test context");
+            ret = -1;
+        }
+        else if (quic->table_cnx_by_net->picohash_hash(&path_x, quic->hash_seed) !=
+            picoquic_hash_addr((struct sockaddr*)&path_x.registered_peer_addr, quic->hash_seed)) {
+            DBG_PRINTF("%s", "Address table does not default to siphash 2-4");
+            ret = -1;
+        }
+        else if (picoquic_set_siphash13(quic, 1) != 0 ||
+            quic->table_cnx_by_net->picohash_hash(&path_x, quic->hash_seed) !=
+            picoquic_hash_addr_siphash13((struct sockaddr*)&path_x.registered_peer_addr, quic->hash_seed)) {
+            DBG_PRINTF("%s", "Address table does not use siphash 1-3");
+            ret = -1;
+        }
+        if (quic != NULL) {
+            picoquic_free(quic);
+        }
+    }
+
+    return ret;
+}
@@ -20,6 +20,7 @@
 */
 
 #include "picoquic_internal.h"
+#include <stdlib.h>
 #include <string.h>
 
 static const uint64_t test_number[] = {
@@ -328,6 +329,135 @@ int varint_test()
     return ret;
 }
 
+/* Check the fast varint decoding paths, which are used when at least 8 octets
+ * are available, then compare the decoding speed to a reference loop over octets.
+ * The timings are only reported in the debug log.
+ */
+#define VARINT_BENCH_NB_VALUES 4096
+#define VARINT_BENCH_NB_ROUNDS 64
+
+static const uint8_t* varint_bench_reference(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* n64)
+{
+    size_t length = VARINT_LEN_T(bytes, size_t);
+
+    if ((size_t)(bytes_max - bytes) < length) {
+        bytes = NULL;
+    }
+    else {
+        uint64_t v = *bytes++ & 0x3F;
+
+        while (--length > 0) {
+            v <<= 8;
+            v += *bytes++;
+        }
+        *n64 = v;
+    }
+
+    return bytes;
+}
+
+int varint_bench_test()
+{
+    int ret = 0;
+    uint8_t test_buf[16];
+    uint8_t* buffer = (uint8_t*)malloc(VARINT_BENCH_NB_VALUES * 8);
+    uint64_t* values = (uint64_t*)malloc(VARINT_BENCH_NB_VALUES * sizeof(uint64_t));
+    const uint8_t* bytes_max = NULL;
+    uint64_t random_ctx = 0xDEADBEEFCAFEull;
+    uint64_t sum[3] = { 0, 0, 0 };
+    uint64_t duration[3] = { 0, 0, 0 };
+
+    /* Decode the test cases with trailing octets, so the fast path is used */
+    for (size_t i = 0; ret == 0 && i < nb_varint_test_cases; i++) {
+        uint64_t n64[2] = { 0, 0 };
+        const uint8_t* bytes;
+
+        memset(test_buf, 0xcc, sizeof(test_buf));
+        memcpy(test_buf, varint_test_cases[i].encoding, varint_test_cases[i].length);
+        if (picoquic_varint_decode(test_buf, sizeof(test_buf), &n64[0]) != varint_test_cases[i].length ||
+            n64[0] != varint_test_cases[i].decoded ||
+            (bytes = picoquic_frames_varint_decode_batch(test_buf, test_buf + sizeof(test_buf), n64, 2)) == NULL ||
+            bytes != test_buf + varint_test_cases[i].length + picoquic_decode_varint_length(test_buf[varint_test_cases[i].length]) ||
+            n64[0] != varint_test_cases[i].decoded) {
+            DBG_PRINTF("Fast varint decoding fails for test case %" PRIst, i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (buffer == NULL || values == NULL)) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        uint8_t* bytes = buffer;
+        uint8_t* end = buffer + VARINT_BENCH_NB_VALUES * 8;
+
+        /* Mix of lengths, biased towards the short encodings common in frames */
+        for (size_t i = 0; bytes != NULL && i < VARINT_BENCH_NB_VALUES; i++) {
+            uint64_t r = picoquic_test_random(&random_ctx);
+            int nb_bits = ((r & 7) < 4) ? 6 : ((r & 7) < 6) ? 14 : ((r & 7) < 7) ? 30 : 62;
+
+            values[i] = (r >> 3) & ((((uint64_t)1) << nb_bits) - 1);
+            bytes = picoquic_frames_varint_encode(bytes, end, values[i]);
+        }
+        if (bytes == NULL) {
+            ret = -1;
+        }
+        else {
+            bytes_max = bytes;
+        }
+    }
+
+    for (int method = 0; ret == 0 && method < 3; method++) {
+        uint64_t start_time = picoquic_current_time();
+
+        for (int round = 0; ret == 0 && round < VARINT_BENCH_NB_ROUNDS; round++) {
+            const uint8_t* bytes = buffer;
+            uint64_t n64[2];
+
+            for (size_t i = 0; bytes != NULL && i < VARINT_BENCH_NB_VALUES; i += (method == 2) ? 2 : 1) {
+                if (method == 0) {
+                    bytes = varint_bench_reference(bytes, bytes_max, &n64[0]);
+                    sum[0] += n64[0];
+                }
+                else if (method == 1) {
+                    bytes = picoquic_frames_varint_decode(bytes, bytes_max, &n64[0]);
+                    sum[1] += n64[0];
+                }
+                else if ((bytes = picoquic_frames_varint_decode_batch(bytes, bytes_max, n64, 2)) != NULL) {
+                    sum[2] += n64[0] + n64[1];
+                }
+            }
+            if (bytes != bytes_max) {
+                DBG_PRINTF("Varint decoding method %d stops at %" PRIst, method,
+                    (bytes == NULL) ? SIZE_MAX : (size_t)(bytes - buffer));
+                ret = -1;
+            }
+        }
+        duration[method] = picoquic_current_time() - start_time;
+    }
+
+    if (ret == 0) {
+        if (sum[1] != sum[0] || sum[2] != sum[0]) {
+            DBG_PRINTF("%s", "Varint decoding methods disagree");
+            ret = -1;
+        }
+        else {
+            DBG_PRINTF("Decoding %d varints: reference %" PRIu64 "us, frames decode %" PRIu64 "us, batch %" PRIu64 "us",
+                VARINT_BENCH_NB_VALUES * VARINT_BENCH_NB_ROUNDS, duration[0], duration[1], duration[2]);
+        }
+    }
+
+    if (buffer != NULL) {
+        free(buffer);
+    }
+    if (values != NULL) {
+        free(values);
+    }
+
+    return ret;
+}
+
 /* Simple implementation of SQRT using UINT64, so we do not have to link 
  * the math library
  */
@@ -105,6 +105,18 @@ static int l4s_congestion_test(picoquic_congestion_algorithm_t* ccalgo, int do_l
             DBG_PRINTF("RTT variant %" PRIu64 ", expected maximum %" PRIu64, test_ctx->cnx_server->path[0]->rtt_variant, max_rttvar);
             ret = -1;
         }
+        else if (do_l4s) {
+            /* Verify that the CE marks were attributed to acknowledged packets */
+            picoquic_path_t* path_x = test_ctx->cnx_server->path[0];
+            uint64_t nb_ce = test_ctx->cnx_server->pkt_ctx[picoquic_packet_context_application].ecn_ce_total_remote;
+
+            if (nb_ce > 0 && (path_x->nb_ce_marked_packets == 0 || path_x->nb_ce_marked_packets > nb_ce ||
+                path_x->ce_marked_bytes > path_x->delivered)) {
+                DBG_PRINTF("CE marks %" PRIu64 ", attributed %" PRIu64 " packets, %" PRIu64 " bytes",
+                    nb_ce, path_x->nb_ce_marked_packets, path_x->ce_marked_bytes);
+                ret = -1;
+            }
+        }
     }
 
     /* Free the resource, which will close the log file.
@@ -41,6 +41,13 @@
 #define MEMLOG_FILE "memlog_file.csv"
 #define MEMLOG_FILE_MP "memlog_file_mp.csv"
 #define MEMLOG_FILE_BAD "no_such_folder/bad\\memlog_file_bad.csv"
+#define MEMLOG_RING_CNX_FILE "memlog_ring_cnx.csv"
+#define MEMLOG_RING_BIN "memlog_ring.bin"
+#define MEMLOG_RING_CSV "memlog_ring.csv"
+#define MEMLOG_RING_SMALL_BIN "memlog_ring_small.bin"
+#define MEMLOG_RING_SMALL_CSV "memlog_ring_small.csv"
+#define MEMLOG_RING_BUDGET 0x100000
+#define MEMLOG_RING_SMALL_BUDGET 0x4000
 #ifdef _WINDOWS
 #define MEMLOG_TEST_REF "picoquictest\\memlog_test_ref.csv"
 #else
@@ -53,7 +60,8 @@ static test_api_stream_desc_t test_scenario_memlog[] = {
     { 4, 0, 100000, 100000 }
 };
 
-int memlog_test_one(int is_multipath, char const * memlog_file_name, int expect_error)
+int memlog_test_one(int is_multipath, char const * memlog_file_name, int expect_error,
+    size_t ring_budget, char const* ring_file_name)
 {
     uint64_t simulated_time = 0;
     uint64_t loss_mask = 0;
@@ -74,6 +82,9 @@ int memlog_test_one(int is_multipath, char const * memlog_file_name, int expect_
             /* Initialize memory log on client or server */
             ret = memlog_init(test_ctx->cnx_client, 100, memlog_file_name);
         }
+        if (ret == 0 && ring_budget > 0) {
+            ret = memlog_ring_init(test_ctx->qclient, ring_budget, ring_file_name);
+        }
     }
 
     if (is_multipath) {
@@ -158,14 +169,149 @@ int memlog_test_one(int is_multipath, char const * memlog_file_name, int expect_
 
 int memlog_test()
 {
-    int ret = memlog_test_one(0, MEMLOG_FILE, 0);
+    int ret = memlog_test_one(0, MEMLOG_FILE, 0, 0, NULL);
 
     if (ret == 0) {
-        ret = memlog_test_one(1, MEMLOG_FILE_MP, 0);
+        ret = memlog_test_one(1, MEMLOG_FILE_MP, 0, 0, NULL);
     }
 
     if (ret == 0) {
-        ret = memlog_test_one(1, MEMLOG_FILE_BAD, 1);
+        ret = memlog_test_one(1, MEMLOG_FILE_BAD, 1, 0, NULL);
+    }
+    return ret;
+}
+
+/* Skip the connection id, path id and start time columns of the ring CSV */
+static char const* memlog_ring_skip_columns(char const* line)
+{
+    for (int i = 0; i < 3 && line != NULL; i++) {
+        line = strchr(line, ',');
+        if (line != NULL) {
+            line++;
+        }
+    }
+    return line;
+}
+
+/* The ring lines of the connection start with the lines of the connection memlog */
+static int memlog_ring_check_prefix(char const* ring_csv, char const* cnx_csv)
+{
+    int ret = 0;
+    int nb_lines = 0;
+    char ring_line[1024];
+    char cnx_line[1024];
+    FILE* F_ring = picoquic_file_open(ring_csv, "r");
+    FILE* F_cnx = picoquic_file_open(cnx_csv, "r");
+
+    if (F_ring == NULL || F_cnx == NULL ||
+        fgets(ring_line, sizeof(ring_line), F_ring) == NULL ||
+        fgets(cnx_line, sizeof(cnx_line), F_cnx) == NULL) {
+        ret = -1;
     }
+
+    while (ret == 0 && fgets(cnx_line, sizeof(cnx_line), F_cnx) != NULL) {
+        char const* data = NULL;
+
+        if (fgets(ring_line, sizeof(ring_line), F_ring) == NULL ||
+            (data = memlog_ring_skip_columns(ring_line)) == NULL || strcmp(data, cnx_line) != 0) {
+            DBG_PRINTF("Ring line %d differs from the connection memlog", nb_lines);
+            ret = -1;
+        }
+        nb_lines++;
+    }
+
+    if (ret == 0 && nb_lines == 0) {
+        ret = -1;
+    }
+
+    (void)picoquic_file_close(F_ring);
+    (void)picoquic_file_close(F_cnx);
+    return ret;
+}
+
+static int memlog_ring_count_lines(char const* csv_file)
+{
+    int nb_lines = -1;
+    char line[1024];
+    FILE* F = picoquic_file_open(csv_file, "r");
+
+    if (F != NULL) {
+        nb_lines = 0;
+        while (fgets(line, sizeof(line), F) != NULL) {
+            nb_lines++;
+        }
+        (void)picoquic_file_close(F);
+    }
+    return nb_lines;
+}
+
+/* After wrapping around, the small ring has the last lines of the large one */
+static int memlog_ring_check_tail(char const* small_csv, char const* large_csv)
+{
+    int ret = 0;
+    int nb_small = memlog_ring_count_lines(small_csv);
+    int nb_large = memlog_ring_count_lines(large_csv);
+    char small_line[1024];
+    char large_line[1024];
+    FILE* F_small = NULL;
+    FILE* F_large = NULL;
+
+    if (nb_small <= 1 || nb_large <= nb_small) {
+        DBG_PRINTF("Ring lines: %d in small, %d in large", nb_small, nb_large);
+        ret = -1;
+    }
+    else if ((F_small = picoquic_file_open(small_csv, "r")) == NULL ||
+        (F_large = picoquic_file_open(large_csv, "r")) == NULL) {
+        ret = -1;
+    }
+    else {
+        for (int i = 0; ret == 0 && i < nb_large - nb_small + 1; i++) {
+            if (fgets(large_line, sizeof(large_line), F_large) == NULL) {
+                ret = -1;
+            }
+        }
+        /* Skip the header of the small ring */
+        if (ret == 0 && fgets(small_line, sizeof(small_line), F_small) == NULL) {
+            ret = -1;
+        }
+        while (ret == 0 && fgets(small_line, sizeof(small_line), F_small) != NULL) {
+            if (fgets(large_line, sizeof(large_line), F_large) == NULL || strcmp(small_line, large_line) != 0) {
+                ret = -1;
+            }
+        }
+    }
+
+    (void)picoquic_file_close(F_small);
+    (void)picoquic_file_close(F_large);
+    return ret;
+}
+
+int memlog_ring_test()
+{
+    int ret = memlog_test_one(0, MEMLOG_RING_CNX_FILE, 0, MEMLOG_RING_BUDGET, MEMLOG_RING_BIN);
+
+    if (ret == 0) {
+        ret = memlog_test_one(0, MEMLOG_RING_CNX_FILE, 0, MEMLOG_RING_SMALL_BUDGET, MEMLOG_RING_SMALL_BIN);
+    }
+
+    if (ret == 0 && (memlog_ring_to_csv(MEMLOG_RING_BIN, MEMLOG_RING_CSV, NULL) != 0 ||
+        memlog_ring_to_csv(MEMLOG_RING_SMALL_BIN, MEMLOG_RING_SMALL_CSV, NULL) != 0)) {
+        DBG_PRINTF("%s", "Cannot convert the memory log rings");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ret = memlog_ring_check_prefix(MEMLOG_RING_CSV, MEMLOG_RING_CNX_FILE);
+    }
+
+    if (ret == 0) {
+        ret = memlog_ring_check_tail(MEMLOG_RING_SMALL_CSV, MEMLOG_RING_CSV);
+    }
+
+    if (ret == 0 && memlog_ring_to_csv(MEMLOG_RING_CNX_FILE, MEMLOG_RING_SMALL_CSV, NULL) == 0) {
+        DBG_PRINTF("%s", "CSV file accepted as memory log ring");
+        ret = -1;
+    }
+
     return ret;
 }
\ No newline at end of file
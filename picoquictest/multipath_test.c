@@ -29,6 +29,7 @@
 #include "logreader.h"
 #include "qlog.h"
 #include "picoquic_bbr.h"
+#include "picoquic_coupled_cc.h"
 
 /* Add the additional links for multipath scenario */
 static int multipath_test_add_links(picoquic_test_tls_api_ctx_t* test_ctx, int mtu_drop)
@@ -452,7 +453,13 @@ typedef enum {
     multipath_test_tunnel,
     multipath_test_fail,
     multipath_test_ab1,
-    multipath_test_discovery
+    multipath_test_discovery,
+    multipath_test_sched_rtt,
+    multipath_test_sched_capacity,
+    multipath_test_sched_redundant,
+    multipath_test_lia,
+    multipath_test_olia,
+    multipath_test_balia
 } multipath_test_enum_t;
 
 #ifdef _WINDOWS
@@ -754,6 +761,10 @@ int multipath_test_one(uint64_t max_completion_microsec, multipath_test_enum_t t
     picoquic_tp_t server_parameters;
     uint64_t original_r_cid_sequence = 0;
     size_t send_buffer_size = 0;
+    int is_sched_test = (test_id == multipath_test_sched_rtt || test_id == multipath_test_sched_capacity ||
+        test_id == multipath_test_sched_redundant);
+    int is_coupled_test = (test_id == multipath_test_lia || test_id == multipath_test_olia ||
+        test_id == multipath_test_balia);
     int ret;
 
     initial_cid.id[2] = (int)test_id;
@@ -783,6 +794,20 @@ int multipath_test_one(uint64_t max_completion_microsec, multipath_test_enum_t t
             multipath_test_perf_links(test_ctx, 0);
             picoquic_set_default_congestion_algorithm(test_ctx->qserver, picoquic_bbr_algorithm);
         }
+        else if (is_sched_test) {
+            /* Wi-Fi and LTE links, with the scheduler set at the server */
+            multipath_test_perf_links(test_ctx, 0);
+            picoquic_set_default_path_scheduler(test_ctx->qserver,
+                (test_id == multipath_test_sched_rtt) ? picoquic_lowest_rtt_scheduler :
+                ((test_id == multipath_test_sched_capacity) ? picoquic_capacity_scheduler : picoquic_redundant_scheduler));
+        }
+        else if (is_coupled_test) {
+            /* Wi-Fi and LTE links, with coupled congestion control at the server */
+            multipath_test_perf_links(test_ctx, 0);
+            picoquic_set_default_congestion_algorithm(test_ctx->qserver,
+                (test_id == multipath_test_lia) ? picoquic_lia_algorithm :
+                ((test_id == multipath_test_olia) ? picoquic_olia_algorithm : picoquic_balia_algorithm));
+        }
         test_ctx->c_to_s_link->queue_delay_max = 2 * test_ctx->c_to_s_link->microsec_latency;
         test_ctx->s_to_c_link->queue_delay_max = 2 * test_ctx->s_to_c_link->microsec_latency;
 
@@ -876,7 +901,7 @@ int multipath_test_one(uint64_t max_completion_microsec, multipath_test_enum_t t
                 /* Simulate an asymmetric "satellite and landline" scenario */
                 multipath_test_sat_links(test_ctx, 1);
             }
-            else if (test_id == multipath_test_perf) {
+            else if (test_id == multipath_test_perf || is_sched_test || is_coupled_test) {
                 multipath_test_perf_links(test_ctx, 1);
             }
             else if (test_id == multipath_test_fail) {
@@ -1150,6 +1175,42 @@ int multipath_test_one(uint64_t max_completion_microsec, multipath_test_enum_t t
         }
     }
 
+    if (ret == 0 && is_sched_test) {
+        if (test_ctx->cnx_server->nb_paths != 2) {
+            DBG_PRINTF("Scheduler test, %d paths on server connection.\n", test_ctx->cnx_server->nb_paths);
+            ret = -1;
+        }
+        else if (test_id == multipath_test_sched_rtt &&
+            test_ctx->cnx_server->path[0]->delivered <= test_ctx->cnx_server->path[1]->delivered) {
+            DBG_PRINTF("Lowest RTT path delivered %" PRIu64 ", other path %" PRIu64 ".\n",
+                test_ctx->cnx_server->path[0]->delivered, test_ctx->cnx_server->path[1]->delivered);
+            ret = -1;
+        }
+        else if (test_id == multipath_test_sched_capacity &&
+            (test_ctx->cnx_server->path[0]->delivered < 200000 || test_ctx->cnx_server->path[1]->delivered < 200000)) {
+            DBG_PRINTF("Capacity scheduler delivered %" PRIu64 " and %" PRIu64 ".\n",
+                test_ctx->cnx_server->path[0]->delivered, test_ctx->cnx_server->path[1]->delivered);
+            ret = -1;
+        }
+        else if (test_id == multipath_test_sched_redundant && test_ctx->cnx_server->nb_redundant_repeat == 0) {
+            DBG_PRINTF("%s", "No redundant repeat on server connection.\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && is_coupled_test) {
+        /* Both paths are used, and the coupling does not starve the slower path */
+        if (test_ctx->cnx_server->nb_paths != 2) {
+            DBG_PRINTF("Coupled CC test, %d paths on server connection.\n", test_ctx->cnx_server->nb_paths);
+            ret = -1;
+        }
+        else if (test_ctx->cnx_server->path[0]->delivered < 100000 || test_ctx->cnx_server->path[1]->delivered < 100000) {
+            DBG_PRINTF("Coupled CC delivered %" PRIu64 " and %" PRIu64 ".\n",
+                test_ctx->cnx_server->path[0]->delivered, test_ctx->cnx_server->path[1]->delivered);
+            ret = -1;
+        }
+    }
+
     if (ret == 0 && test_id == multipath_test_discovery) {
         if (test_ctx->nb_address_observed < 2) {
             DBG_PRINTF("Got % addresses observed", test_ctx->nb_address_observed);
@@ -1400,6 +1461,53 @@ int multipath_discovery_test()
     return multipath_test_one(max_completion_microsec, multipath_test_discovery);
 }
 
+/* Multipath schedulers, on the Wi-Fi plus LTE links of the perf test.
+ */
+int multipath_sched_rtt_test()
+{
+    uint64_t max_completion_microsec = 1000000;
+
+    return multipath_test_one(max_completion_microsec, multipath_test_sched_rtt);
+}
+
+int multipath_sched_capacity_test()
+{
+    uint64_t max_completion_microsec = 1000000;
+
+    return multipath_test_one(max_completion_microsec, multipath_test_sched_capacity);
+}
+
+int multipath_sched_redundant_test()
+{
+    uint64_t max_completion_microsec = 1000000;
+
+    return multipath_test_one(max_completion_microsec, multipath_test_sched_redundant);
+}
+
+/* Coupled congestion control tests. Same Wi-Fi and LTE links as the scheduler
+ * tests, with the LIA, OLIA or BALIA algorithm at the server.
+ */
+int multipath_lia_test()
+{
+    uint64_t max_completion_microsec = 1200000;
+
+    return multipath_test_one(max_completion_microsec, multipath_test_lia);
+}
+
+int multipath_olia_test()
+{
+    uint64_t max_completion_microsec = 1200000;
+
+    return multipath_test_one(max_completion_microsec, multipath_test_olia);
+}
+
+int multipath_balia_test()
+{
+    uint64_t max_completion_microsec = 1200000;
+
+    return multipath_test_one(max_completion_microsec, multipath_test_balia);
+}
+
 /* Monopath tests:
  * Enable the multipath option, but use only a single path. The gal of the tests is to verify that
  * these "monopath" scenarios perform just as well as if multipath was not enabled.
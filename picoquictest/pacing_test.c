@@ -287,8 +287,8 @@ pacing_test_t pacing_events[] = {
     {1000, 1536, 1536,      0, 0, 10000, 0,        0, 1,      0,  200000, UINT64_MAX  },
     {1000, 1536, 1536,      0, 0, 10000, 0,        0, 1,      0,  100000, UINT64_MAX  },
     {1000, 1536, 1536,      0, 0, 10000, 0,        0, 1,      0,       0, UINT64_MAX  },
-    {1000, 1536, 1536,      0, 0, 10000, 0,        0, 0,      0,       0, 1101  },
-    {1050, 1536, 1536,      0, 0, 10000, 0,        0, 0,      0,   50000, 1101  },
+    {1000, 1536, 1536,      0, 0, 10000, 0,        0, 0,      0,       0, 1100  },
+    {1050, 1536, 1536,      0, 0, 10000, 0,        0, 0,      0,   50000, 1100  },
     {1101, 1536, 1536,      0, 0, 10000, 0,        0, 1,      0,    1000, UINT64_MAX  }
 };
 
@@ -345,4 +345,115 @@ int pacing_repeat_test()
         }
     }
     return ret;
-}
\ No newline at end of file
+}
+
+/* Test the precision of the pacing engine at high data rates, where the
+ * packet time is not a whole number of nanoseconds, and the sending of
+ * packets ahead of their departure time within the pacing horizon.
+ */
+int pacing_precision_test()
+{
+    int ret = 0;
+    picoquic_pacing_t pacing = { 0 };
+    const double test_rate = 1300000000.0;
+    const uint64_t test_quantum = 0x10000;
+    const size_t test_mtu = 1500;
+    const int nb_target = 100000;
+    uint64_t current_time = 0;
+    int nb_sent = 0;
+    int nb_round = 0;
+
+    picoquic_pacing_init(&pacing, current_time);
+    picoquic_update_pacing_parameters(&pacing, test_rate, test_quantum, test_mtu, 10000, NULL);
+
+    while (ret == 0 && nb_sent < nb_target) {
+        uint64_t next_time = UINT64_MAX;
+
+        nb_round++;
+        if (nb_round > 4 * nb_target) {
+            DBG_PRINTF("Pacing needs more that %d rounds for %d packets", nb_round, nb_target);
+            ret = -1;
+        }
+        else if (picoquic_is_authorized_by_pacing(&pacing, current_time, &next_time, 0, NULL)) {
+            nb_sent++;
+            picoquic_update_pacing_data_after_send(&pacing, test_mtu, test_mtu, current_time);
+        }
+        else if (next_time <= current_time || next_time == UINT64_MAX) {
+            DBG_PRINTF("Pacing next = %" PRIu64 ", current = %" PRIu64, next_time, current_time);
+            ret = -1;
+        }
+        else {
+            current_time = next_time;
+        }
+    }
+
+    if (ret == 0) {
+        /* The sending time should match the rate, minus the initial burst */
+        uint64_t time_expected = (uint64_t)((((double)nb_target) * test_mtu * 1000000.0) / test_rate);
+        uint64_t time_min = time_expected - (pacing.bucket_max / 1000) - 2;
+        uint64_t time_max = time_expected + 2;
+
+        if (current_time < time_min || current_time > time_max) {
+            DBG_PRINTF("Pacing used = %" PRIu64 ", expected [%" PRIu64 ", %" PRIu64 "]",
+                current_time, time_min, time_max);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Test the horizon, with a packet time of 12 microseconds */
+        const uint64_t horizon = 100;
+        const int64_t packet_time_nanosec = 12000;
+        uint64_t last_departure = 0;
+        uint64_t next_time = UINT64_MAX;
+        size_t budget;
+
+        memset(&pacing, 0, sizeof(pacing));
+        current_time = 0;
+        nb_sent = 0;
+        picoquic_pacing_init(&pacing, current_time);
+        picoquic_set_pacing_data_horizon(&pacing, horizon);
+        picoquic_update_pacing_parameters(&pacing, 125000000.0, 2 * test_mtu, test_mtu, 10000, NULL);
+        current_time = 1000;
+        budget = picoquic_get_pacing_data_budget(&pacing, current_time);
+
+        while (ret == 0 && picoquic_is_authorized_by_pacing(&pacing, current_time, &next_time, 0, NULL)) {
+            picoquic_update_pacing_data_after_send(&pacing, test_mtu, test_mtu, current_time);
+            if (pacing.last_departure_nanosec < current_time * 1000 ||
+                pacing.last_departure_nanosec > current_time * 1000 + horizon * 1000 ||
+                (nb_sent > 1 && pacing.last_departure_nanosec != last_departure + packet_time_nanosec)) {
+                DBG_PRINTF("Packet %d, unexpected departure %" PRIu64, nb_sent, pacing.last_departure_nanosec);
+                ret = -1;
+            }
+            last_departure = pacing.last_departure_nanosec;
+            nb_sent++;
+        }
+
+        if (ret == 0 && (size_t)nb_sent != budget) {
+            DBG_PRINTF("Sent %d packets within horizon, budget %zu", nb_sent, budget);
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            /* The next packet can be sent as soon as its departure is within the horizon */
+            if (next_time == UINT64_MAX || next_time <= current_time) {
+                DBG_PRINTF("Unexpected next time %" PRIu64, next_time);
+                ret = -1;
+            }
+            else if (!picoquic_is_authorized_by_pacing(&pacing, next_time, &next_time, 0, NULL)) {
+                DBG_PRINTF("Not authorized at next time %" PRIu64, next_time);
+                ret = -1;
+            }
+            else {
+                picoquic_update_pacing_data_after_send(&pacing, test_mtu, test_mtu, next_time);
+                if (pacing.last_departure_nanosec != next_time * 1000 + horizon * 1000 ||
+                    pacing.last_departure_nanosec != last_departure + packet_time_nanosec) {
+                    DBG_PRINTF("Wake at %" PRIu64 ", departure %" PRIu64, next_time, pacing.last_departure_nanosec);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
@@ -40,6 +40,8 @@
 #define SVG_LOG_REF "picoquictest\\svglog_ref.svg"
 #define SVG_LOG_OUTPUT ".\\0102030405060708.svg"
 #define CIDSET_OUTPUT ".\\cidset.txt"
+#define QLOG_FILE_OUTPUT ".\\picolog_file.qlog"
+#define QLOG_INDEX_OUTPUT ".\\picolog_index.qlog"
 
 #else
 #define PICOLOG_BIN_INPUT "picoquictest/picolog_test_input.log"
@@ -47,6 +49,8 @@
 #define SVG_LOG_REF "picoquictest/svglog_ref.svg"
 #define SVG_LOG_OUTPUT "./0102030405060708.svg"
 #define CIDSET_OUTPUT "./cidset.txt"
+#define QLOG_FILE_OUTPUT "./picolog_file.qlog"
+#define QLOG_INDEX_OUTPUT "./picolog_index.qlog"
 
 #endif
 typedef struct app_conversion_context_st
@@ -163,3 +167,110 @@ int picolog_basic_test()
 
     return ret;
 }
+
+/* Indexed conversion: the index must find the same connections as
+ * binlog_list_cids, the conversion from the index must produce the
+ * same qlog as the conversion from the file, and the SVG conversion
+ * by a pool of threads must match the reference. */
+typedef struct st_picolog_index_test_ctx_t {
+    const binlog_index_t* index;
+    const char* binlog_name;
+    const char* template_name;
+} picolog_index_test_ctx_t;
+
+static int test_convert_svg_indexed(const picoquic_connection_id_t* cid, void* ptr)
+{
+    const picolog_index_test_ctx_t* ctx = (const picolog_index_test_ctx_t*)ptr;
+    FILE* f_template = picoquic_file_open(ctx->template_name, "r");
+    int ret = -1;
+
+    if (f_template != NULL) {
+        ret = svg_convert_indexed(cid, ctx->index, f_template, ctx->binlog_name, ".");
+        (void)picoquic_file_close(f_template);
+    }
+
+    return ret;
+}
+
+int picolog_index_test()
+{
+    char log_test_input[512];
+    char svg_template[512];
+    uint16_t flags = 0;
+    uint64_t log_time = 0;
+    FILE* f_binlog = NULL;
+    binlog_index_t* index = NULL;
+    picohash_table* cids = NULL;
+    int ret = picoquic_get_input_path(log_test_input, sizeof(log_test_input), picoquic_solution_dir, PICOLOG_BIN_INPUT);
+
+    if (ret == 0) {
+        ret = picoquic_get_input_path(svg_template, sizeof(svg_template), picoquic_solution_dir, PICOLOG_SVG_TEMPLATE);
+    }
+
+    if (ret == 0 && binlog_index_open("no_such_file.log", &flags, &log_time) != NULL) {
+        DBG_PRINTF("%s", "Index created for a missing file.\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        if ((f_binlog = picoquic_open_cc_log_file_for_read(log_test_input, &flags, &log_time)) == NULL ||
+            (index = binlog_index_open(log_test_input, &flags, &log_time)) == NULL ||
+            (cids = cidset_create()) == NULL) {
+            DBG_PRINTF("Cannot open or index %s\n", log_test_input);
+            ret = -1;
+        }
+        else {
+            binlog_list_cids(f_binlog, cids);
+            if (cids->count == 0 || cids->count != binlog_index_nb_cids(index)) {
+                DBG_PRINTF("Index has %" PRIst " connections, expected %" PRIst "\n", binlog_index_nb_cids(index), cids->count);
+                ret = -1;
+            }
+            for (size_t i = 0; ret == 0 && i < binlog_index_nb_cids(index); i++) {
+                if (!cidset_has_cid(cids, binlog_index_cid(index, i))) {
+                    ret = -1;
+                }
+            }
+            if (ret == 0 && binlog_index_cid(index, binlog_index_nb_cids(index)) != NULL) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        const picoquic_connection_id_t* cid = binlog_index_cid(index, 0);
+
+        if ((ret = qlog_convert(cid, f_binlog, log_test_input, QLOG_FILE_OUTPUT, NULL, flags)) == 0 &&
+            (ret = qlog_convert_indexed(cid, index, log_test_input, QLOG_INDEX_OUTPUT, NULL, flags)) == 0) {
+            ret = picoquic_test_compare_text_files(QLOG_INDEX_OUTPUT, QLOG_FILE_OUTPUT);
+            if (ret != 0) {
+                DBG_PRINTF("%s", "Indexed qlog differs from file qlog.\n");
+            }
+        }
+    }
+
+    if (ret == 0) {
+        picolog_index_test_ctx_t ctx;
+
+        ctx.index = index;
+        ctx.binlog_name = log_test_input;
+        ctx.template_name = svg_template;
+        ret = binlog_index_iterate(index, 2, test_convert_svg_indexed, &ctx);
+    }
+
+    if (ret == 0) {
+        char svglog_ref[512];
+
+        ret = picoquic_get_input_path(svglog_ref, sizeof(svglog_ref), picoquic_solution_dir, SVG_LOG_REF);
+        if (ret == 0) {
+            ret = picoquic_test_compare_text_files(SVG_LOG_OUTPUT, svglog_ref);
+        }
+    }
+
+    binlog_index_close(index);
+    (void)picoquic_file_close(f_binlog);
+    if (cids != NULL) {
+        (void)cidset_delete(cids);
+    }
+
+    return ret;
+}
@@ -27,6 +27,7 @@
 #include "picoquic_utils.h"
 #include "picotls.h"
 #include "picoquic_lb.h"
+#include "picoquic_lb_router.h"
 #include <string.h>
 #include "picoquictest_internal.h"
 
@@ -986,6 +987,339 @@ int cid_for_lb_test()
     return ret;
 }
 
+/* Batch decoding of CIDs. For each test configuration, generate a batch of
+ * CIDs with different "server use" bytes, mark a few of them with the wrong
+ * length, and verify that the batch decoding matches the single CID
+ * verification, both through the QUIC API and through the standalone decoder.
+ */
+#define CID_FOR_LB_BATCH_SIZE 70
+
+static int cid_for_lb_batch_test_one(picoquic_quic_t* quic, int test_id, picoquic_load_balancer_config_t* config,
+    picoquic_connection_id_t* init_cid)
+{
+    int ret = 0;
+    picoquic_connection_id_t cid[CID_FOR_LB_BATCH_SIZE];
+    const uint8_t* cid_bytes[CID_FOR_LB_BATCH_SIZE];
+    uint64_t server_id64[CID_FOR_LB_BATCH_SIZE];
+    size_t nb_valid = 0;
+
+    if (picoquic_lb_compat_cid_config(quic, config) != 0) {
+        DBG_PRINTF("CID batch test #%d fails, could not configure the context.\n", test_id);
+        ret = -1;
+    }
+    else {
+        picoquic_load_balancer_cid_context_t* lb_ctx = (picoquic_load_balancer_cid_context_t*)quic->cnx_id_callback_ctx;
+
+        for (int i = 0; i < CID_FOR_LB_BATCH_SIZE; i++) {
+            cid[i] = *init_cid;
+            cid[i].id[cid[i].id_len - 1] ^= (uint8_t)i;
+            quic->cnx_id_callback_fn(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+                quic->cnx_id_callback_ctx, &cid[i]);
+            if (i % 7 == 3) {
+                cid[i].id_len--;
+            }
+            else {
+                nb_valid++;
+            }
+            cid_bytes[i] = cid[i].id;
+        }
+
+        if (picoquic_lb_compat_cid_verify_batch(quic->cnx_id_callback_ctx, cid, CID_FOR_LB_BATCH_SIZE, server_id64) != nb_valid) {
+            DBG_PRINTF("CID batch test #%d fails, unexpected number of decoded CIDs.\n", test_id);
+            ret = -1;
+        }
+        for (int i = 0; ret == 0 && i < CID_FOR_LB_BATCH_SIZE; i++) {
+            uint64_t expected = (i % 7 == 3) ? UINT64_MAX : config->server_id64;
+
+            if (server_id64[i] != expected || picoquic_lb_compat_cid_verify(quic, quic->cnx_id_callback_ctx, &cid[i]) != expected) {
+                DBG_PRINTF("CID batch test #%d fails, cid[%d] decodes to %" PRIu64 " instead of %" PRIu64,
+                    test_id, i, server_id64[i], expected);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0) {
+            /* Decode the raw bytes, without the length information */
+            if (picoquic_lb_decode_server_ids(&lb_ctx->decoder, cid_bytes, NULL,
+                CID_FOR_LB_BATCH_SIZE, server_id64) != CID_FOR_LB_BATCH_SIZE) {
+                DBG_PRINTF("CID batch test #%d fails, raw CIDs not all decoded.\n", test_id);
+                ret = -1;
+            }
+            for (int i = 0; ret == 0 && i < CID_FOR_LB_BATCH_SIZE; i++) {
+                if (server_id64[i] != config->server_id64) {
+                    DBG_PRINTF("CID batch test #%d fails, raw cid[%d] decodes to %" PRIu64,
+                        test_id, i, server_id64[i]);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    picoquic_lb_compat_cid_config_free(quic);
+
+    return ret;
+}
+
+int cid_for_lb_batch_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Could not create the quic context.");
+        ret = -1;
+    }
+    else {
+        for (int i = 0; i < NB_LB_CONFIG_TEST && ret == 0; i++) {
+            ret = cid_for_lb_batch_test_one(quic, i, &cid_for_lb_test_config[i], &cid_for_lb_test_init[i]);
+        }
+
+        picoquic_free(quic);
+    }
+    return ret;
+}
+
+/* Stateless router. For a sample of test configurations, generate CIDs for
+ * three server IDs, and verify that short and long header packets using these
+ * CIDs reach the right backend, that client Initials are hashed consistently
+ * over the healthy backends, and that the health probes work.
+ */
+#define LB_ROUTER_TEST_NB_BACKENDS 3
+
+static size_t lb_router_test_packet(uint8_t* packet, picoquic_connection_id_t* cid, int is_long_header)
+{
+    size_t length = 0;
+
+    if (is_long_header) {
+        /* Version 1 handshake packet */
+        packet[length++] = 0xe0;
+        packet[length++] = 0;
+        packet[length++] = 0;
+        packet[length++] = 0;
+        packet[length++] = 1;
+        packet[length++] = cid->id_len;
+    }
+    else {
+        packet[length++] = 0x40;
+    }
+    memcpy(packet + length, cid->id, cid->id_len);
+    length += cid->id_len;
+    if (is_long_header) {
+        packet[length++] = 0;
+    }
+    memset(packet + length, 0x5a, 32);
+    length += 32;
+
+    return length;
+}
+
+static int lb_router_test_one(picoquic_quic_t* quic, int test_id, picoquic_load_balancer_config_t* config,
+    picoquic_connection_id_t* init_cid)
+{
+    int ret = 0;
+    picoquic_load_balancer_config_t variant = *config;
+    uint8_t packets[2 * LB_ROUTER_TEST_NB_BACKENDS][64];
+    const uint8_t* packet[2 * LB_ROUTER_TEST_NB_BACKENDS];
+    size_t length[2 * LB_ROUTER_TEST_NB_BACKENDS];
+    int backend_index[2 * LB_ROUTER_TEST_NB_BACKENDS];
+    uint64_t server_id[LB_ROUTER_TEST_NB_BACKENDS];
+    picoquic_lb_decoder_t decoder;
+    picoquic_lb_router_t router;
+    void* ecb_enc = NULL;
+    void* ecb_dec = NULL;
+    uint64_t current_time = 1000000;
+
+    memset(&router, 0, sizeof(router));
+
+    /* Create CIDs and packets for three servers */
+    for (int i = 0; ret == 0 && i < LB_ROUTER_TEST_NB_BACKENDS; i++) {
+        picoquic_connection_id_t cid = *init_cid;
+
+        server_id[i] = config->server_id64 ^ (uint64_t)i;
+        variant.server_id64 = server_id[i];
+        if (picoquic_lb_compat_cid_config(quic, &variant) != 0) {
+            ret = -1;
+        }
+        else {
+            quic->cnx_id_callback_fn(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+                quic->cnx_id_callback_ctx, &cid);
+            for (int k = 0; k < 2; k++) {
+                length[2 * i + k] = lb_router_test_packet(packets[2 * i + k], &cid, k);
+                packet[2 * i + k] = packets[2 * i + k];
+            }
+        }
+        picoquic_lb_compat_cid_config_free(quic);
+    }
+
+    if (ret == 0) {
+        if (config->method != picoquic_load_balancer_cid_clear) {
+            ecb_enc = picoquic_aes128_ecb_create(1, config->cid_encryption_key);
+            ecb_dec = picoquic_aes128_ecb_create(0, config->cid_encryption_key);
+        }
+        if (picoquic_lb_decoder_init(&decoder, config->method, config->first_byte_encodes_length,
+            config->server_id_length, config->nonce_length, config->connection_id_length,
+            picoquic_aes128_ecb_encrypt, ecb_enc, ecb_dec) != 0 ||
+            picoquic_lb_router_init(&router, &decoder, LB_ROUTER_TEST_NB_BACKENDS, 0x123456789abcdefull) != 0) {
+            DBG_PRINTF("Router test #%d, cannot create the router", test_id);
+            ret = -1;
+        }
+        /* Add the backends out of order, to test the sorted index */
+        for (int i = LB_ROUTER_TEST_NB_BACKENDS - 1; ret == 0 && i >= 0; i--) {
+            if (picoquic_lb_router_add_backend(&router, server_id[i], current_time) != LB_ROUTER_TEST_NB_BACKENDS - 1 - i) {
+                ret = -1;
+            }
+        }
+        if (ret == 0 && picoquic_lb_router_add_backend(&router, server_id[0], current_time) >= 0) {
+            DBG_PRINTF("Router test #%d, duplicate server ID accepted", test_id);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Packets with a server CID go to the server */
+        picoquic_lb_router_route_batch(&router, packet, length, 2 * LB_ROUTER_TEST_NB_BACKENDS, backend_index);
+        for (int i = 0; ret == 0 && i < 2 * LB_ROUTER_TEST_NB_BACKENDS; i++) {
+            if (backend_index[i] != LB_ROUTER_TEST_NB_BACKENDS - 1 - i / 2) {
+                DBG_PRINTF("Router test #%d, packet %d routed to %d", test_id, i, backend_index[i]);
+                ret = -1;
+            }
+        }
+        /* Truncated short header packets are dropped */
+        if (ret == 0 && picoquic_lb_router_route(&router, packet[0], config->connection_id_length) != -1) {
+            DBG_PRINTF("Router test #%d, truncated packet not dropped", test_id);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Client Initials are hashed consistently. Use a DCID length that does not
+         * match the configuration, so the DCIDs cannot be decoded. */
+        picoquic_connection_id_t icid;
+        uint8_t initial[64];
+        size_t initial_length;
+        int first_choice[16];
+        int nb_used[LB_ROUTER_TEST_NB_BACKENDS] = { 0 };
+
+        memset(&icid, 0, sizeof(icid));
+        icid.id_len = (config->connection_id_length == 8) ? 9 : 8;
+        for (int i = 0; ret == 0 && i < 16; i++) {
+            icid.id[0] = (uint8_t)i;
+            icid.id[1] = (uint8_t)test_id;
+            initial_length = lb_router_test_packet(initial, &icid, 1);
+            initial[0] = 0xc0;
+            first_choice[i] = picoquic_lb_router_route(&router, initial, initial_length);
+            if (first_choice[i] < 0 || first_choice[i] != picoquic_lb_router_route(&router, initial, initial_length)) {
+                DBG_PRINTF("Router test #%d, initial %d not routed consistently", test_id, i);
+                ret = -1;
+            }
+            else {
+                nb_used[first_choice[i]]++;
+            }
+        }
+        if (ret == 0 && nb_used[0] == 16) {
+            DBG_PRINTF("Router test #%d, initials not spread", test_id);
+            ret = -1;
+        }
+
+        /* Only backend 1 answers the probes. The others become unhealthy,
+         * and the hashed traffic moves to backend 1. Traffic with a
+         * server ID still reaches the unhealthy servers. */
+        if (ret == 0) {
+            uint8_t probe[PICOQUIC_LB_ROUTER_PROBE_SIZE];
+            uint8_t response[64];
+            size_t response_length = 0;
+
+            current_time += router.health_timeout;
+            if (picoquic_lb_router_format_probe(&router, 1, probe, sizeof(probe), current_time) != PICOQUIC_LB_ROUTER_PROBE_SIZE ||
+                router.backends[1].next_probe_time != current_time + router.probe_interval) {
+                ret = -1;
+            }
+            else {
+                /* Version negotiation, echoing the CIDs */
+                response[response_length++] = 0x80;
+                memset(response + response_length, 0, 4);
+                response_length += 4;
+                response[response_length++] = probe[6 + probe[5]];
+                memcpy(response + response_length, probe + 7 + probe[5], probe[6 + probe[5]]);
+                response_length += probe[6 + probe[5]];
+                response[response_length++] = probe[5];
+                memcpy(response + response_length, probe + 6, probe[5]);
+                response_length += probe[5];
+                memcpy(response + response_length, probe + 1, 4);
+                response_length += 4;
+
+                response[7] ^= 1;
+                if (picoquic_lb_router_process_probe_response(&router, response, response_length, current_time) != -1) {
+                    DBG_PRINTF("Router test #%d, bad probe response accepted", test_id);
+                    ret = -1;
+                }
+                response[7] ^= 1;
+                if (picoquic_lb_router_process_probe_response(&router, response, response_length, current_time) != 1) {
+                    DBG_PRINTF("Router test #%d, probe response not accepted", test_id);
+                    ret = -1;
+                }
+            }
+            picoquic_lb_router_update_health(&router, current_time + 1);
+            if (ret == 0 && (router.backends[0].is_healthy || !router.backends[1].is_healthy || router.backends[2].is_healthy)) {
+                DBG_PRINTF("Router test #%d, unexpected health status", test_id);
+                ret = -1;
+            }
+        }
+        for (int i = 0; ret == 0 && i < 16; i++) {
+            icid.id[0] = (uint8_t)i;
+            initial_length = lb_router_test_packet(initial, &icid, 1);
+            initial[0] = 0xc0;
+            if (picoquic_lb_router_route(&router, initial, initial_length) != 1) {
+                DBG_PRINTF("Router test #%d, initial %d not moved to the healthy backend", test_id, i);
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            picoquic_lb_router_route_batch(&router, packet, length, 2 * LB_ROUTER_TEST_NB_BACKENDS, backend_index);
+            for (int i = 0; ret == 0 && i < 2 * LB_ROUTER_TEST_NB_BACKENDS; i++) {
+                if (backend_index[i] != LB_ROUTER_TEST_NB_BACKENDS - 1 - i / 2) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    picoquic_lb_router_clear(&router);
+    if (ecb_enc != NULL) {
+        picoquic_aes128_ecb_free(ecb_enc);
+    }
+    if (ecb_dec != NULL) {
+        picoquic_aes128_ecb_free(ecb_dec);
+    }
+
+    return ret;
+}
+
+int lb_router_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Could not create the quic context.");
+        ret = -1;
+    }
+    else {
+        for (int i = 0; i < NB_LB_CONFIG_TEST && ret == 0; i++) {
+            ret = lb_router_test_one(quic, i, &cid_for_lb_test_config[i], &cid_for_lb_test_init[i]);
+        }
+
+        picoquic_free(quic);
+    }
+    return ret;
+}
+
 /* CID for LG Tests.
  * The CLI parameter takes as input a text string that can be parsed as a LB "config" struct.
  * The test starts with a set of "Good" configurations and the corresponding value,
@@ -86,7 +86,8 @@
 *   e.g., having link break, be restored, or change data rate and latency.
 * - the "L4S" implementation is a place holder.
 * - we do not support complex AQM
-* - we do not simulate CPU consumption.
+* - the CPU consumption model is a simple per packet and per callback cost,
+*   see picoquic_ns_cpu_spec_t.
 * - we do not simulate UDP GSO, i.e., preparing batches of packets.
 * 
 * The picoquic library comes with a set of CC algorithm implementation. It
@@ -97,6 +98,7 @@
 #define QUIC_PERF_ALPN "perf"
 #define PICOQUIC_NS_NB_LINKS 2
 #define PICOQUIC_NS_NB_NODES 2
+#define PICOQUIC_NS_PACKET_POOL_MAX 1024
 
 typedef struct st_picoquic_ns_client_t {
     uint64_t start_time;
@@ -109,10 +111,30 @@ typedef struct st_picoquic_ns_client_t {
     uint64_t seed_rtt;
 } picoquic_ns_client_t;
 
+/* CPU state of a node. When the model is enabled, packets arriving from the
+ * link are queued until the CPU is available, and the node does not prepare
+ * packets before "busy_until". The costs are in nanoseconds, the simulated
+ * time in microseconds, so the remainder is carried over to the next charge.
+ */
+typedef struct st_picoquic_ns_cpu_t {
+    picoquic_ns_cpu_spec_t spec;
+    int is_enabled;
+    uint64_t busy_until;
+    uint64_t carry_ns;
+    uint64_t total_ns;
+    uint64_t nb_app_callbacks;
+    picoquictest_sim_packet_t* first_packet;
+    picoquictest_sim_packet_t* last_packet;
+    size_t nb_queued;
+    uint64_t nb_drops;
+} picoquic_ns_cpu_t;
+
 typedef struct st_picoquic_ns_ctx_t {
     picoquic_quic_t* q_ctx[PICOQUIC_NS_NB_NODES];
     struct sockaddr_in addr[PICOQUIC_NS_NB_NODES];
     picoquictest_sim_link_t* link[PICOQUIC_NS_NB_LINKS];
+    picoquictest_sim_sched_t link_sched; /* one slot per link, ordered by next arrival */
+    picoquictest_sim_packet_pool_t packet_pool;
     uint64_t simulated_time;
     int nb_connections;
     picoquic_ns_link_spec_t* vary_link_spec;
@@ -123,8 +145,24 @@ typedef struct st_picoquic_ns_ctx_t {
     uint64_t next_cnx_start_time;
     picoquic_ns_client_t* client_ctx[PICOQUIC_NS_MAX_CLIENTS];
     uint8_t packet_ecn_default;
+    picoquic_ns_cpu_t cpu[PICOQUIC_NS_NB_NODES];
 } picoquic_ns_ctx_t;
 
+/* Application callback of the simulated connections. The calls are
+ * counted per node, so that the CPU model can charge their cost. */
+static int picoquic_ns_app_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+    picoquic_ns_ctx_t* cc_ctx = (picoquic_ns_ctx_t*)picoquic_get_default_callback_context(picoquic_get_quic_ctx(cnx));
+
+    if (cc_ctx != NULL) {
+        int node_id = (picoquic_get_quic_ctx(cnx) == cc_ctx->q_ctx[0]) ? 0 : 1;
+        cc_ctx->cpu[node_id].nb_app_callbacks++;
+    }
+    return quicperf_callback(cnx, stream_id, bytes, length, fin_or_event, callback_ctx, v_stream_ctx);
+}
+
 
 int picoquic_ns_server_callback(picoquic_cnx_t* cnx,
     uint64_t stream_id, uint8_t* bytes, size_t length,
@@ -170,11 +208,11 @@ int picoquic_ns_server_callback(picoquic_cnx_t* cnx,
             ret = -1;
         }
         else {
-            picoquic_set_callback(cnx, quicperf_callback, perf_ctx);
+            picoquic_set_callback(cnx, picoquic_ns_app_callback, perf_ctx);
         }
     }
     if (ret == 0) {
-        ret = quicperf_callback(cnx, stream_id, bytes, length, fin_or_event, perf_ctx, v_stream_ctx);
+        ret = picoquic_ns_app_callback(cnx, stream_id, bytes, length, fin_or_event, perf_ctx, v_stream_ctx);
     }
     return ret;
 }
@@ -298,6 +336,8 @@ int picoquic_ns_create_default_link_spec(picoquic_ns_ctx_t* cc_ctx, picoquic_ns_
             cc_ctx->vary_link_spec[i].is_wifi_jitter = spec->is_wifi_jitter;
             cc_ctx->vary_link_spec[i].queue_delay_max = spec->queue_delay_max;
             cc_ctx->vary_link_spec[i].l4s_max = spec->l4s_max;
+            cc_ctx->vary_link_spec[i].nb_loss_in_burst = spec->nb_loss_in_burst;
+            cc_ctx->vary_link_spec[i].packets_between_losses = spec->packets_between_losses;
         }
     }
     return ret;
@@ -396,6 +436,8 @@ int picoquic_ns_create_link(picoquic_ns_ctx_t* cc_ctx, int link_id)
         cc_ctx->link[link_id]->packets_between_losses = link_spec->packets_between_losses;
         cc_ctx->link[link_id]->packets_sent_next_burst = cc_ctx->link[link_id]->packets_sent +
             link_spec->packets_between_losses;
+        cc_ctx->link[link_id]->pool = &cc_ctx->packet_pool;
+        picoquictest_sim_link_set_sched(cc_ctx->link[link_id], &cc_ctx->link_sched, (size_t)link_id);
     }
     return ret;
 }
@@ -406,6 +448,10 @@ int picoquic_ns_create_links(picoquic_ns_ctx_t* cc_ctx, picoquic_ns_spec_t* spec
     int ret = picoquic_ns_create_link_spec(cc_ctx, spec);
 
     /* next create the link with parameters of the first scenario */
+    if (ret == 0) {
+        cc_ctx->packet_pool.nb_free_max = PICOQUIC_NS_PACKET_POOL_MAX;
+        ret = picoquictest_sim_sched_init(&cc_ctx->link_sched, PICOQUIC_NS_NB_LINKS);
+    }
     if (ret == 0) {
         for (int i = 0; ret == 0 && i < PICOQUIC_NS_NB_LINKS; i++) {
             ret = picoquic_ns_create_link(cc_ctx, i);
@@ -442,6 +488,18 @@ void picoquic_ns_delete_ctx(picoquic_ns_ctx_t* cc_ctx)
             cc_ctx->link[i] = NULL;
         }
     }
+    picoquictest_sim_sched_clear(&cc_ctx->link_sched);
+    /* free the packets waiting for the CPU */
+    for (int i = 0; i < PICOQUIC_NS_NB_NODES; i++) {
+        while (cc_ctx->cpu[i].first_packet != NULL) {
+            picoquictest_sim_packet_t* packet = cc_ctx->cpu[i].first_packet;
+            cc_ctx->cpu[i].first_packet = packet->next_packet;
+            picoquictest_sim_pool_release_packet(&cc_ctx->packet_pool, packet);
+        }
+        cc_ctx->cpu[i].last_packet = NULL;
+        cc_ctx->cpu[i].nb_queued = 0;
+    }
+    picoquictest_sim_pool_clear(&cc_ctx->packet_pool);
 
     /* delete the link specifications */
     if (cc_ctx->vary_link_spec != NULL) {
@@ -560,6 +618,14 @@ picoquic_ns_ctx_t* picoquic_ns_create_ctx(picoquic_ns_spec_t* spec, FILE* err_fd
         if (spec->l4s_max > 0) {
             cc_ctx->packet_ecn_default = PICOQUIC_ECN_ECT_1;
         }
+        /* Set the CPU models, node 0 is the server, node 1 the client */
+        cc_ctx->cpu[0].spec = spec->server_cpu;
+        cc_ctx->cpu[1].spec = spec->client_cpu;
+        for (int i = 0; i < PICOQUIC_NS_NB_NODES; i++) {
+            picoquic_ns_cpu_spec_t* cpu_spec = &cc_ctx->cpu[i].spec;
+            cc_ctx->cpu[i].is_enabled = (cpu_spec->receive_ns > 0 || cpu_spec->send_ns > 0 ||
+                cpu_spec->crypto_ns > 0 || cpu_spec->app_callback_ns > 0);
+        }
         /* Create the client contexts */
         if (spec->nb_connections > PICOQUIC_NS_MAX_CLIENTS || spec->nb_connections == 0) {
             ret = -1;
@@ -583,6 +649,37 @@ picoquic_ns_ctx_t* picoquic_ns_create_ctx(picoquic_ns_spec_t* spec, FILE* err_fd
     return cc_ctx;
 }
 
+/* Charge a cost to the CPU of a node. The CPU becomes busy from the current
+ * time, or from the end of the previous task if it is still busy.
+ */
+static void picoquic_ns_cpu_charge(picoquic_ns_cpu_t* cpu, uint64_t cost_ns, uint64_t current_time)
+{
+    if (cpu->busy_until < current_time) {
+        cpu->busy_until = current_time;
+    }
+    cpu->carry_ns += cost_ns;
+    cpu->busy_until += cpu->carry_ns / 1000;
+    cpu->carry_ns %= 1000;
+    cpu->total_ns += cost_ns;
+}
+
+static int picoquic_ns_submit_packet(picoquic_ns_ctx_t* cc_ctx, int node_id, picoquictest_sim_packet_t* packet)
+{
+    picoquic_ns_cpu_t* cpu = &cc_ctx->cpu[node_id];
+    uint64_t nb_app_callbacks = cpu->nb_app_callbacks;
+    picoquic_cnx_t* first_cnx = NULL;
+    int ret = picoquic_incoming_packet_ex(cc_ctx->q_ctx[node_id], packet->bytes, packet->length,
+        (struct sockaddr*)&packet->addr_from, (struct sockaddr*)&packet->addr_to, 0,
+        packet->ecn_mark, &first_cnx, cc_ctx->simulated_time);
+    picoquictest_sim_pool_release_packet(&cc_ctx->packet_pool, packet);
+
+    if (cpu->is_enabled) {
+        picoquic_ns_cpu_charge(cpu, cpu->spec.receive_ns + cpu->spec.crypto_ns +
+            (cpu->nb_app_callbacks - nb_app_callbacks) * cpu->spec.app_callback_ns, cc_ctx->simulated_time);
+    }
+    return ret;
+}
+
 int picoquic_ns_incoming_packet(picoquic_ns_ctx_t* cc_ctx, int link_id)
 {
     int ret = 0;
@@ -590,17 +687,51 @@ int picoquic_ns_incoming_packet(picoquic_ns_ctx_t* cc_ctx, int link_id)
     picoquictest_sim_packet_t* packet = picoquictest_sim_link_dequeue(cc_ctx->link[link_id],
         cc_ctx->simulated_time);
 
-    /* TODO, but not yet: add management of CPU time, see picoquic_test_endpoint_t */
-    /* For now, just submit the packet to the specified server.
-     * The context id is set to the same value of the node id
+    /* The context id is set to the same value of the node id.
+     * If the node simulates CPU costs, the packet waits in the receive queue
+     * until the CPU is available.
      */
     if (packet != NULL) {
         int node_id = link_id;
-        picoquic_cnx_t* first_cnx = NULL;
-        ret = picoquic_incoming_packet_ex(cc_ctx->q_ctx[node_id], packet->bytes, packet->length,
-            (struct sockaddr*)&packet->addr_from, (struct sockaddr*)&packet->addr_to, 0,
-            packet->ecn_mark, &first_cnx, cc_ctx->simulated_time);
-        free(packet);
+        picoquic_ns_cpu_t* cpu = &cc_ctx->cpu[node_id];
+
+        if (!cpu->is_enabled) {
+            ret = picoquic_ns_submit_packet(cc_ctx, node_id, packet);
+        }
+        else if (cpu->spec.receive_queue_max > 0 && cpu->nb_queued >= cpu->spec.receive_queue_max) {
+            cpu->nb_drops++;
+            picoquictest_sim_pool_release_packet(&cc_ctx->packet_pool, packet);
+        }
+        else {
+            packet->next_packet = NULL;
+            if (cpu->last_packet == NULL) {
+                cpu->first_packet = packet;
+            }
+            else {
+                cpu->last_packet->next_packet = packet;
+            }
+            cpu->last_packet = packet;
+            cpu->nb_queued++;
+        }
+    }
+    return ret;
+}
+
+/* Process the first packet in the CPU receive queue of a node */
+int picoquic_ns_cpu_dequeue(picoquic_ns_ctx_t* cc_ctx, int node_id)
+{
+    int ret = 0;
+    picoquic_ns_cpu_t* cpu = &cc_ctx->cpu[node_id];
+    picoquictest_sim_packet_t* packet = cpu->first_packet;
+
+    if (packet != NULL) {
+        cpu->first_packet = packet->next_packet;
+        if (cpu->first_packet == NULL) {
+            cpu->last_packet = NULL;
+        }
+        cpu->nb_queued--;
+        packet->next_packet = NULL;
+        ret = picoquic_ns_submit_packet(cc_ctx, node_id, packet);
     }
     return ret;
 }
@@ -608,7 +739,9 @@ int picoquic_ns_incoming_packet(picoquic_ns_ctx_t* cc_ctx, int link_id)
 int picoquic_ns_prepare_packet(picoquic_ns_ctx_t* cc_ctx, int node_id, int* is_active)
 {
     int ret = 0;
-    picoquictest_sim_packet_t* packet = picoquictest_sim_link_create_packet();
+    picoquic_ns_cpu_t* cpu = &cc_ctx->cpu[node_id];
+    uint64_t nb_app_callbacks = cpu->nb_app_callbacks;
+    picoquictest_sim_packet_t* packet = picoquictest_sim_pool_get_packet(&cc_ctx->packet_pool);
     if (packet == NULL) {
         ret = -1;
     }
@@ -636,7 +769,15 @@ int picoquic_ns_prepare_packet(picoquic_ns_ctx_t* cc_ctx, int node_id, int* is_a
         }
         else {
             /* No packet to send, or other errors */
-            free(packet);
+            picoquictest_sim_pool_release_packet(&cc_ctx->packet_pool, packet);
+            packet = NULL;
+        }
+        if (cpu->is_enabled) {
+            uint64_t cost_ns = (cpu->nb_app_callbacks - nb_app_callbacks) * cpu->spec.app_callback_ns;
+            if (packet != NULL) {
+                cost_ns += cpu->spec.send_ns + cpu->spec.crypto_ns;
+            }
+            picoquic_ns_cpu_charge(cpu, cost_ns, cc_ctx->simulated_time);
         }
     }
     return ret;
@@ -656,7 +797,7 @@ int picoquic_ns_start_connection(picoquic_ns_ctx_t* cc_ctx, int cnx_id)
     }
     else {
         picoquic_set_congestion_algorithm_ex(cc_ctx->client_ctx[cnx_id]->cnx, cc_ctx->client_ctx[cnx_id]->cc_algo, cc_ctx->client_ctx[cnx_id]->cc_option_string);
-        picoquic_set_callback(cc_ctx->client_ctx[cnx_id]->cnx, quicperf_callback,
+        picoquic_set_callback(cc_ctx->client_ctx[cnx_id]->cnx, picoquic_ns_app_callback,
             cc_ctx->client_ctx[cnx_id]->quicperf_ctx);
         cc_ctx->client_ctx[cnx_id]->cnx->local_parameters.max_datagram_frame_size = 1532;
         ret = picoquic_start_client_cnx(cc_ctx->client_ctx[cnx_id]->cnx);
@@ -742,6 +883,7 @@ void picoquic_ns_simlink_reset(picoquictest_sim_link_t* link, double data_rate_i
         picoquictest_sim_link_submit(link, packet, current_time);
         packet = next_packet;
     }
+    picoquictest_sim_link_sched_refresh(link);
 }
 
 /* If it is time for link state transition, apply the requested link changes,
@@ -784,6 +926,7 @@ int picoquic_ns_step(picoquic_ns_ctx_t* cc_ctx, int* is_active)
         no_action,
         link_transition,
         link_departure,
+        cpu_dequeue,
         prepare_packet,
         start_connection
     } next_action = no_action;
@@ -794,21 +937,37 @@ int picoquic_ns_step(picoquic_ns_ctx_t* cc_ctx, int* is_active)
         next_action = link_transition;
     }
 
-    /* Check whether there is something to receive */
-    for (int i = 0; i < PICOQUIC_NS_NB_LINKS; i++) {
-        if (cc_ctx->link[i]->first_packet != NULL) {
-            uint64_t t_arrival = picoquictest_sim_link_next_arrival(cc_ctx->link[i], t_next_action);
-            if (t_arrival < t_next_action) {
-                t_next_action = t_arrival;
-                link_id_next = i;
-                next_action = link_departure;
+    /* Check whether there is something to receive. The links keep their
+     * next arrival time in the scheduler, so there is no need to poll them. */
+    {
+        size_t link_slot = 0;
+        uint64_t t_arrival = picoquictest_sim_sched_next(&cc_ctx->link_sched, &link_slot);
+        if (t_arrival < t_next_action) {
+            t_next_action = t_arrival;
+            link_id_next = (int)link_slot;
+            next_action = link_departure;
+        }
+    }
+
+    /* Check whether a CPU can process a queued packet */
+    for (int i = 0; i < PICOQUIC_NS_NB_NODES; i++) {
+        if (cc_ctx->cpu[i].first_packet != NULL) {
+            uint64_t t_next = (cc_ctx->cpu[i].busy_until > cc_ctx->simulated_time) ?
+                cc_ctx->cpu[i].busy_until : cc_ctx->simulated_time;
+            if (t_next < t_next_action) {
+                t_next_action = t_next;
+                node_id_next = i;
+                next_action = cpu_dequeue;
             }
         }
     }
 
-    /* Check whether there is something to send */
+    /* Check whether there is something to send. A busy CPU delays the preparation. */
     for (int i = 0; i < PICOQUIC_NS_NB_NODES; i++) {
         uint64_t t_next = picoquic_get_next_wake_time(cc_ctx->q_ctx[i], t_next_action);
+        if (cc_ctx->cpu[i].is_enabled && t_next < cc_ctx->cpu[i].busy_until) {
+            t_next = cc_ctx->cpu[i].busy_until;
+        }
         if (t_next < t_next_action) {
             t_next_action = t_next;
             node_id_next = i;
@@ -842,6 +1001,10 @@ int picoquic_ns_step(picoquic_ns_ctx_t* cc_ctx, int* is_active)
         ret = picoquic_ns_incoming_packet(cc_ctx, link_id_next);
         *is_active = 1;
         break;
+    case cpu_dequeue:
+        ret = picoquic_ns_cpu_dequeue(cc_ctx, node_id_next);
+        *is_active = 1;
+        break;
     case prepare_packet:
         ret = picoquic_ns_prepare_packet(cc_ctx, node_id_next, is_active);
         break;
@@ -951,14 +1114,51 @@ int picoquic_ns_media_check(quicperf_ctx_t* quicperf_ctx, picoquic_ns_spec_t* sp
     return ret;
 }
 
+static void picoquic_ns_get_result(picoquic_ns_ctx_t* cc_ctx, picoquic_ns_result_t* result)
+{
+    if (cc_ctx != NULL) {
+        result->completion_time = cc_ctx->simulated_time;
+        result->server_cpu_time = cc_ctx->cpu[0].total_ns / 1000;
+        result->client_cpu_time = cc_ctx->cpu[1].total_ns / 1000;
+        result->nb_cpu_queue_drops = cc_ctx->cpu[0].nb_drops + cc_ctx->cpu[1].nb_drops;
+        if (cc_ctx->client_ctx[0] != NULL) {
+            picoquic_cnx_t* cnx = cc_ctx->client_ctx[0]->cnx;
+
+            if (cc_ctx->client_ctx[0]->quicperf_ctx != NULL) {
+                result->data_sent = cc_ctx->client_ctx[0]->quicperf_ctx->data_sent;
+                result->data_received = cc_ctx->client_ctx[0]->quicperf_ctx->data_received;
+            }
+            if (cnx != NULL) {
+                result->nb_packets_sent = cnx->nb_packets_sent;
+                result->nb_retransmission_total = cnx->nb_retransmission_total;
+                if (cnx->path != NULL && cnx->nb_paths > 0) {
+                    result->rtt_min = cnx->path[0]->rtt_min;
+                    result->smoothed_rtt = cnx->path[0]->smoothed_rtt;
+                }
+            }
+        }
+    }
+}
+
 int picoquic_ns(picoquic_ns_spec_t* spec, FILE* err_fd)
+{
+    return picoquic_ns_ex(spec, err_fd, NULL);
+}
+
+int picoquic_ns_ex(picoquic_ns_spec_t* spec, FILE* err_fd, picoquic_ns_result_t* result)
 {
     int ret = 0;
     picoquic_ns_ctx_t* cc_ctx = picoquic_ns_create_ctx(spec, err_fd);
     int nb_inactive = 0;
 
+    if (result != NULL) {
+        memset(result, 0, sizeof(picoquic_ns_result_t));
+    }
+
     if (cc_ctx == NULL) {
-        fprintf(err_fd, "Cannot allocate simulation context.\n");
+        if (err_fd != NULL) {
+            fprintf(err_fd, "Cannot allocate simulation context.\n");
+        }
         ret = -1;
     }
     while (ret == 0) {
@@ -990,11 +1190,15 @@ int picoquic_ns(picoquic_ns_spec_t* spec, FILE* err_fd)
             break;
         }
     }
-    if (err_fd != NULL && ret != 0) {
+    if (err_fd != NULL && ret != 0 && cc_ctx != NULL) {
         fprintf(err_fd, "Simulated time %" PRIu64 ", ret = %d(0x%x)\n",
             cc_ctx->simulated_time, ret, ret);
     }
 
+    if (result != NULL) {
+        picoquic_ns_get_result(cc_ctx, result);
+    }
+
     if (ret == 0 &&
         (cc_ctx->client_ctx[0]->cnx == NULL ||
         (cc_ctx->client_ctx[0]->cnx->cnx_state == picoquic_state_disconnected &&
@@ -1029,5 +1233,8 @@ int picoquic_ns(picoquic_ns_spec_t* spec, FILE* err_fd)
     if (cc_ctx != NULL) {
         picoquic_ns_delete_ctx(cc_ctx);
     }
+    if (result != NULL) {
+        result->ret = ret;
+    }
     return ret;
 }
@@ -59,6 +59,21 @@ typedef struct st_picoquic_ns_link_spec_t {
     int is_wifi_jitter; /* 0 = guaussian jitter (default), 1 = wifi jitter emulation. */
 } picoquic_ns_link_spec_t;
 
+/* CPU cost model of a simulated node, costs in nanoseconds.
+ * The costs are charged in simulated time: while the CPU of a node is busy,
+ * the node does not prepare packets, and the incoming packets wait in a
+ * receive queue. The crypto cost is charged once per packet received
+ * or sent, the application cost once per call to the application callback.
+ * The model is disabled if all costs are zero.
+ */
+typedef struct st_picoquic_ns_cpu_spec_t {
+    uint64_t receive_ns; /* processing of one incoming packet */
+    uint64_t send_ns; /* preparation of one outgoing packet */
+    uint64_t crypto_ns; /* decryption or encryption of one packet */
+    uint64_t app_callback_ns; /* one call to the application callback */
+    size_t receive_queue_max; /* if specified, packets arriving when the receive queue is full are dropped */
+} picoquic_ns_cpu_spec_t;
+
 typedef struct st_picoquic_ns_spec_t {
     uint64_t main_start_time;
     uint64_t main_target_time;
@@ -79,6 +94,8 @@ typedef struct st_picoquic_ns_spec_t {
     int is_wifi_jitter; /* 0 = guaussian jitter (default), 1 = wifi jitter emulation. */
     uint64_t queue_delay_max; /* if specified, specify the max buffer queuing for the link, in microseconds */
     uint64_t l4s_max; /* if specified, specify the max buffer queuing for the link, in microseconds */
+    uint64_t nb_loss_in_burst; /* if specified, loose that many packet in burst of errors every interval */
+    uint64_t packets_between_losses; /* packets to send between two losses */
     picoquic_connection_id_t icid; /* if specified, set the ICID of connections. Last byte will be overwriten by connection number */
     char const* qlog_dir; /* if specified, set the qlog directory, and request qlog traces. */
     /* The specification can either specify one of the preprogrammed link scenarios,
@@ -95,9 +112,62 @@ typedef struct st_picoquic_ns_spec_t {
     char const* media_excluded;
     uint64_t media_latency_average;
     uint64_t media_latency_max;
+    picoquic_ns_cpu_spec_t server_cpu; /* CPU cost model of the server node */
+    picoquic_ns_cpu_spec_t client_cpu; /* CPU cost model of the client node */
 } picoquic_ns_spec_t;
 
+/* Summary of a simulation run, filled by picoquic_ns_ex.
+ * The connection statistics are only available if the main connection
+ * context still exists at the end of the simulation.
+ */
+typedef struct st_picoquic_ns_result_t {
+    int ret; /* same value as returned by picoquic_ns */
+    uint64_t completion_time; /* simulated time at the end of the run, microseconds */
+    uint64_t data_sent; /* sent by the main client */
+    uint64_t data_received; /* received by the main client */
+    uint64_t nb_packets_sent; /* by the main client */
+    uint64_t nb_retransmission_total; /* by the main client */
+    uint64_t rtt_min; /* default path of the main client */
+    uint64_t smoothed_rtt; /* default path of the main client */
+    uint64_t server_cpu_time; /* simulated CPU time, microseconds, zero if no CPU model */
+    uint64_t client_cpu_time; /* simulated CPU time, microseconds, zero if no CPU model */
+    uint64_t nb_cpu_queue_drops; /* packets dropped at full receive queues, both nodes */
+} picoquic_ns_result_t;
+
 int picoquic_ns(picoquic_ns_spec_t* spec, FILE* err_fd);
+int picoquic_ns_ex(picoquic_ns_spec_t* spec, FILE* err_fd, picoquic_ns_result_t* result);
+
+/* Parameter sweep.
+ * The sweep runs one simulation for each combination of the values listed
+ * in the matrix. Each dimension with zero values keeps the value found in
+ * the base specification. The loss interval sets "packets_between_losses",
+ * with bursts of one packet unless "nb_loss_in_burst" is set in the base spec.
+ * The link variations of the base spec are ignored, since the swept values
+ * are applied through the default link specification.
+ *
+ * Simulations run in "nb_threads" worker threads, each simulation using
+ * its own contexts and its own simulated time. One CSV line is written per
+ * combination, in matrix order, after all simulations complete.
+ */
+typedef struct st_picoquic_ns_sweep_t {
+    picoquic_ns_spec_t base_spec;
+    size_t nb_cc_algos;
+    picoquic_congestion_algorithm_t const** cc_algos;
+    size_t nb_data_rates;
+    double* data_rates_in_gbps;
+    size_t nb_latencies;
+    uint64_t* latencies;
+    size_t nb_jitters;
+    uint64_t* jitters;
+    size_t nb_loss_intervals;
+    uint64_t* loss_intervals;
+    size_t nb_queue_delays;
+    uint64_t* queue_delays;
+    int nb_threads;
+} picoquic_ns_sweep_t;
+
+size_t picoquic_ns_sweep_size(picoquic_ns_sweep_t* sweep);
+int picoquic_ns_sweep(picoquic_ns_sweep_t* sweep, FILE* csv_fd, FILE* err_fd);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,249 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Parameter sweep for the picoquic_ns simulator.
+ *
+ * The simulations are independent of each other: each one creates its own
+ * quic contexts and links, and runs in its own virtual time. The sweep can
+ * thus run them in parallel. The worker threads pick the next combination
+ * from a shared counter, and store the result in the slot of that
+ * combination, so the CSV output does not depend on the number of threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "tls_api.h"
+#include "picoquic_ns.h"
+
+typedef struct st_picoquic_ns_sweep_ctx_t {
+    picoquic_ns_sweep_t* sweep;
+    picoquic_ns_result_t* results;
+    size_t nb_runs;
+    size_t next_run;
+    picoquic_mutex_t mutex;
+} picoquic_ns_sweep_ctx_t;
+
+typedef struct st_picoquic_ns_sweep_point_t {
+    picoquic_congestion_algorithm_t const* cc_algo;
+    double data_rate_in_gbps;
+    uint64_t latency;
+    uint64_t jitter;
+    uint64_t loss_interval;
+    uint64_t queue_delay_max;
+} picoquic_ns_sweep_point_t;
+
+static size_t picoquic_ns_sweep_dim(size_t nb_values)
+{
+    return (nb_values == 0) ? 1 : nb_values;
+}
+
+size_t picoquic_ns_sweep_size(picoquic_ns_sweep_t* sweep)
+{
+    return picoquic_ns_sweep_dim(sweep->nb_cc_algos) *
+        picoquic_ns_sweep_dim(sweep->nb_data_rates) *
+        picoquic_ns_sweep_dim(sweep->nb_latencies) *
+        picoquic_ns_sweep_dim(sweep->nb_jitters) *
+        picoquic_ns_sweep_dim(sweep->nb_loss_intervals) *
+        picoquic_ns_sweep_dim(sweep->nb_queue_delays);
+}
+
+/* Decode the run index, last dimension varying fastest */
+static void picoquic_ns_sweep_get_point(picoquic_ns_sweep_t* sweep, size_t run_index, picoquic_ns_sweep_point_t* point)
+{
+    picoquic_ns_spec_t* base = &sweep->base_spec;
+    size_t x;
+
+    x = run_index % picoquic_ns_sweep_dim(sweep->nb_queue_delays);
+    run_index /= picoquic_ns_sweep_dim(sweep->nb_queue_delays);
+    point->queue_delay_max = (sweep->nb_queue_delays == 0) ? base->queue_delay_max : sweep->queue_delays[x];
+
+    x = run_index % picoquic_ns_sweep_dim(sweep->nb_loss_intervals);
+    run_index /= picoquic_ns_sweep_dim(sweep->nb_loss_intervals);
+    point->loss_interval = (sweep->nb_loss_intervals == 0) ? base->packets_between_losses : sweep->loss_intervals[x];
+
+    x = run_index % picoquic_ns_sweep_dim(sweep->nb_jitters);
+    run_index /= picoquic_ns_sweep_dim(sweep->nb_jitters);
+    point->jitter = (sweep->nb_jitters == 0) ? base->jitter : sweep->jitters[x];
+
+    x = run_index % picoquic_ns_sweep_dim(sweep->nb_latencies);
+    run_index /= picoquic_ns_sweep_dim(sweep->nb_latencies);
+    point->latency = (sweep->nb_latencies == 0) ? base->latency : sweep->latencies[x];
+
+    x = run_index % picoquic_ns_sweep_dim(sweep->nb_data_rates);
+    run_index /= picoquic_ns_sweep_dim(sweep->nb_data_rates);
+    point->data_rate_in_gbps = (sweep->nb_data_rates == 0) ? base->data_rate_in_gbps : sweep->data_rates_in_gbps[x];
+
+    x = run_index % picoquic_ns_sweep_dim(sweep->nb_cc_algos);
+    point->cc_algo = (sweep->nb_cc_algos == 0) ? base->main_cc_algo : sweep->cc_algos[x];
+}
+
+static void picoquic_ns_sweep_run_one(picoquic_ns_sweep_t* sweep, size_t run_index, picoquic_ns_result_t* result)
+{
+    picoquic_ns_spec_t spec = sweep->base_spec;
+    picoquic_ns_sweep_point_t point;
+
+    picoquic_ns_sweep_get_point(sweep, run_index, &point);
+
+    spec.main_cc_algo = point.cc_algo;
+    spec.data_rate_in_gbps = point.data_rate_in_gbps;
+    spec.latency = point.latency;
+    spec.jitter = point.jitter;
+    spec.queue_delay_max = point.queue_delay_max;
+    spec.packets_between_losses = point.loss_interval;
+    if (spec.packets_between_losses > 0 && spec.nb_loss_in_burst == 0) {
+        spec.nb_loss_in_burst = 1;
+    }
+    spec.vary_link_nb = 0;
+    spec.vary_link_spec = NULL;
+    /* Log files would be shared between parallel runs */
+    spec.qperf_log = NULL;
+    spec.qlog_dir = NULL;
+
+    (void)picoquic_ns_ex(&spec, NULL, result);
+}
+
+static picoquic_thread_return_t picoquic_ns_sweep_worker(void* v_ctx)
+{
+    picoquic_ns_sweep_ctx_t* ctx = (picoquic_ns_sweep_ctx_t*)v_ctx;
+
+    while (1) {
+        size_t run_index;
+
+        picoquic_lock_mutex(&ctx->mutex);
+        run_index = ctx->next_run;
+        if (run_index < ctx->nb_runs) {
+            ctx->next_run++;
+        }
+        picoquic_unlock_mutex(&ctx->mutex);
+
+        if (run_index >= ctx->nb_runs) {
+            break;
+        }
+        picoquic_ns_sweep_run_one(ctx->sweep, run_index, &ctx->results[run_index]);
+    }
+
+    picoquic_thread_do_return;
+}
+
+static int picoquic_ns_sweep_write_csv(picoquic_ns_sweep_ctx_t* ctx, FILE* csv_fd)
+{
+    int ret = 0;
+
+    if (fprintf(csv_fd, "run, cc, rate_gbps, latency, jitter, loss_interval, queue_delay, ret, completion_time, data_sent, data_received, packets_sent, retransmissions, rtt_min, smoothed_rtt\n") <= 0) {
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < ctx->nb_runs; i++) {
+        picoquic_ns_sweep_point_t point;
+        picoquic_ns_result_t* result = &ctx->results[i];
+
+        picoquic_ns_sweep_get_point(ctx->sweep, i, &point);
+        if (fprintf(csv_fd, "%zu, %s, %f, %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %d, %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
+            i, (point.cc_algo == NULL) ? "default" : point.cc_algo->congestion_algorithm_id,
+            point.data_rate_in_gbps, point.latency, point.jitter, point.loss_interval, point.queue_delay_max,
+            result->ret, result->completion_time, result->data_sent, result->data_received,
+            result->nb_packets_sent, result->nb_retransmission_total, result->rtt_min, result->smoothed_rtt) <= 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int picoquic_ns_sweep(picoquic_ns_sweep_t* sweep, FILE* csv_fd, FILE* err_fd)
+{
+    int ret = 0;
+    int nb_threads = (sweep->nb_threads <= 0) ? 1 : sweep->nb_threads;
+    int nb_started = 0;
+    picoquic_thread_t* threads = NULL;
+    picoquic_ns_sweep_ctx_t ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.sweep = sweep;
+    ctx.nb_runs = picoquic_ns_sweep_size(sweep);
+
+    if ((size_t)nb_threads > ctx.nb_runs) {
+        nb_threads = (int)ctx.nb_runs;
+    }
+
+    if ((ctx.results = (picoquic_ns_result_t*)calloc(ctx.nb_runs, sizeof(picoquic_ns_result_t))) == NULL ||
+        (threads = (picoquic_thread_t*)calloc(nb_threads, sizeof(picoquic_thread_t))) == NULL) {
+        if (err_fd != NULL) {
+            fprintf(err_fd, "Cannot allocate sweep context for %zu runs.\n", ctx.nb_runs);
+        }
+        ret = -1;
+    }
+    else if (picoquic_create_mutex(&ctx.mutex) != 0) {
+        if (err_fd != NULL) {
+            fprintf(err_fd, "Cannot create the sweep mutex.\n");
+        }
+        ret = -1;
+    }
+    else {
+        /* The TLS initialization is not thread safe, do it before starting the workers */
+        picoquic_tls_api_init();
+
+        while (nb_started < nb_threads) {
+            if (picoquic_create_thread(&threads[nb_started], picoquic_ns_sweep_worker, &ctx) != 0) {
+                if (err_fd != NULL) {
+                    fprintf(err_fd, "Cannot start sweep thread %d.\n", nb_started);
+                }
+                if (nb_started == 0) {
+                    ret = -1;
+                }
+                break;
+            }
+            nb_started++;
+        }
+        for (int i = 0; i < nb_started; i++) {
+            (void)picoquic_wait_thread(threads[i]);
+            picoquic_delete_thread(&threads[i]);
+        }
+        (void)picoquic_delete_mutex(&ctx.mutex);
+    }
+
+    if (ret == 0 && csv_fd != NULL) {
+        ret = picoquic_ns_sweep_write_csv(&ctx, csv_fd);
+    }
+
+    if (ret == 0 && err_fd != NULL) {
+        size_t nb_failed = 0;
+        for (size_t i = 0; i < ctx.nb_runs; i++) {
+            if (ctx.results[i].ret != 0) {
+                nb_failed++;
+            }
+        }
+        if (nb_failed > 0) {
+            fprintf(err_fd, "%zu of %zu simulations failed.\n", nb_failed, ctx.nb_runs);
+        }
+    }
+
+    if (threads != NULL) {
+        free(threads);
+    }
+    if (ctx.results != NULL) {
+        free(ctx.results);
+    }
+
+    return ret;
+}
@@ -45,10 +45,25 @@ int util_threading_test();
 int picohash_test();
 int picohash_bytes_test();
 int siphash_test();
+int siphash13_test();
 int picohash_embedded_test();
+int picohash_open_test();
 int picolog_basic_test();
+int picolog_index_test();
 int bytestream_test();
 int create_cnx_test();
+int object_pool_test();
+int misc_frame_pool_test();
+int packet_size_class_test();
+int packet_index_test();
+int ack_batch_test();
+int stateless_queue_test();
+int prewarm_pools_test();
+int path_table_test();
+int loss_check_path_test();
+int cnx_layout_test();
+int clock_cache_test();
+int reset_filter_test();
 int create_quic_test();
 int parseheadertest();
 int incoming_initial_test();
@@ -61,12 +76,17 @@ int sendacktest();
 int sendack_loop_test();
 int ackfrq_basic_test();
 int ackfrq_short_test();
+int ackfrq_adaptive_test();
 #if 0
 /* The TLS API connect test is only useful when debugging issues step by step */
 int tls_api_connect_test();
 #endif
 int tls_api_test();
 int tls_api_inject_hs_ack_test();
+int async_sign_test();
+int key_share_pool_test();
+int initial_key_cache_test();
+int cert_compress_test();
 int tls_api_silence_test();
 int tls_api_loss_test(uint64_t mask);
 int tls_api_client_first_loss_test();
@@ -89,24 +109,50 @@ int tls_api_q2_and_r2_stream_test();
 int implicit_ack_test();
 int stateless_reset_test();
 int stateless_reset_bad_test();
+int zero_copy_stream_test();
+int stream_iov_test();
+int stream_cork_test();
+int stream_repeat_queue_test();
+int stream_repeat_strip_test();
+int cnx_handoff_test();
+int delivery_batch_test();
+int send_backlog_test();
+int timer_slack_test();
+int stream_deadline_test();
+int fec_repair_test();
+int preemptive_budget_test();
+int reorder_window_test();
 int stateless_reset_client_test();
 int stateless_reset_handshake_test();
 int immediate_close_test();
 int sim_link_test();
+int sim_link_sched_test();
 int tls_api_very_long_stream_test();
 int tls_api_very_long_max_test();
 int tls_api_very_long_with_err_test();
 int tls_api_very_long_congestion_test();
+int cnx_memory_budget_test();
+int rcv_window_autotune_test();
+int max_streams_autotune_test();
+int in_place_decryption_test();
+int cnx_hibernation_test();
+int prepare_next_packets_test();
 int tls_api_retry_test();
 int tls_api_retry_large_test();
+int admission_control_test();
+int compact_closing_test();
 int ackrange_test();
+int sack_list_array_test();
 int ack_of_ack_test();
 int ack_disorder_test();
 int ack_horizon_test();
+int ack_scan_floor_test();
+int ack_range_cap_test();
 int tls_api_two_connections_test();
 int cleartext_aead_test();
 int tls_api_multiple_versions_test();
 int varint_test();
+int varint_bench_test();
 int sqrt_for_test_test();
 int tls_api_client_losses_test();
 int tls_api_server_losses_test();
@@ -133,6 +179,8 @@ int mtu_blocked_test();
 int mtu_delayed_test();
 int mtu_required_test();
 int mtu_max_test();
+int mtu_jumbo_test();
+int pmtu_cache_test();
 int mtu_drop_bbr_test();
 int mtu_drop_cubic_test();
 int mtu_drop_dcubic_test();
@@ -141,11 +189,14 @@ int mtu_drop_newreno_test();
 int spurious_retransmit_test();
 int pn_ctr_test();
 int cleartext_pn_enc_test();
+int aead_seal_batch_test();
 int pn_enc_1rtt_test();
 int tls_zero_share_test();
 int transport_param_log_test();
+int transport_param_cache_test();
 int bad_certificate_test();
 int set_verify_certificate_callback_test();
+int cert_verify_cache_test();
 int virtual_time_test();
 int tls_different_params_test();
 int tls_quant_params_test();
@@ -164,6 +215,7 @@ int spinbit_random_test();
 int spinbit_randclient_test();
 int spinbit_null_test();
 int spinbit_bad_test();
+int spinbit_observer_test();
 int loss_bit_test();
 int client_error_test();
 int client_only_test();
@@ -175,6 +227,8 @@ int zero_rtt_no_coal_test();
 int zero_rtt_many_losses_test();
 int zero_rtt_long_test();
 int zero_rtt_delay_test();
+int zero_rtt_replay_test();
+int ticket_key_rotation_test();
 int parse_frame_test();
 int frames_repeat_test();
 int frames_ackack_error_test();
@@ -192,7 +246,26 @@ int sockloop_migration_test();
 int sockloop_nat_test();
 int sockloop_thread_test();
 int sockloop_thread_name_test();
+int sockloop_batch_test();
+int sockloop_uring_test();
+int sockloop_select_test();
+int sockloop_txtime_test();
+int sockloop_zerocopy_test();
+int sockloop_command_test();
+int sockloop_rio_test();
+int sockloop_provider_test();
+int sockloop_busy_poll_test();
+int sockloop_affinity_test();
+int sockloop_timer_slack_test();
+int sockloop_reuseport_test();
+int sockloop_dispatch_test();
+int sockloop_gro_test();
+int sockloop_timestamp_test();
+int sockloop_metrics_test();
 int splay_test();
+int rbtree_test();
+int splay_bench_test();
+int timer_wheel_test();
 int TlsStreamFrameTest();
 int draft17_vector_test();
 int dtn_basic_test();
@@ -203,6 +276,7 @@ int fuzz_test();
 int random_tester_test();
 int random_gauss_test();
 int random_public_tester_test();
+int random_buffered_test();
 int cnxid_stash_test();
 int new_cnxid_test();
 int transmit_cnxid_test();
@@ -212,6 +286,7 @@ int transmit_cnxid_retire_disable_test();
 int transmit_cnxid_retire_early_test();
 int probe_api_test();
 int memlog_test();
+int memlog_ring_test();
 int migration_test();
 int migration_test_long(); 
 int migration_test_loss();
@@ -226,6 +301,7 @@ int new_rotated_key_test();
 int key_rotation_test();
 int key_rotation_auto_server();
 int key_rotation_auto_client();
+int key_rotation_precompute_test();
 int false_migration_test();
 int nat_handshake_test();
 int key_rotation_vector_test();
@@ -243,7 +319,15 @@ int qlog_trace_test();
 int qlog_trace_auto_test();
 int qlog_trace_only_test();
 int qlog_trace_ecn_test();
+int qlog_trace_async_test();
+int qlog_trace_auto_async_test();
+int qlog_trace_compressed_test();
+int qlog_trace_compressed_async_test();
+int qlog_trace_seq_test();
+int qlog_trace_seq_async_test();
+int log_policy_test();
 int perflog_test();
+int cpu_accounting_test();
 int rebinding_stress_test();
 int many_short_loss_test();
 int random_padding_test();
@@ -256,6 +340,7 @@ int ecf1_final_loss_test();
 int ec5c_silly_cid_test();
 int ec9a_preemptive_amok_test();
 int error_reason_test();
+int textlog_rate_limit_test();
 int idle_server_test();
 int idle_timeout_test();
 int reset_ack_max_test();
@@ -289,6 +374,8 @@ int cc_ns_wifi_bad_bbr_test();
 int cc_ns_varylink_test();
 int cc_ns_satellite_test();
 int cc_ns_media_test();
+int cc_ns_sweep_test();
+int cc_ns_cpu_cost_test();
 int satellite_basic_test();
 int satellite_seeded_test();
 int satellite_seeded_bbr1_test();
@@ -310,6 +397,13 @@ int bdp_basic_test();
 int bdp_reno_test();
 int bdp_cubic_test();
 int bdp_bbr1_test();
+int careful_resume_test();
+int cc_snapshot_test();
+int cc_fixed_point_test();
+int cc_hystart_pp_test();
+int cc_telemetry_test();
+int cnx_stats_test();
+int cc_replay_test();
 int bdp_rtt_test();
 int bdp_ip_test();
 int bdp_delay_test();
@@ -328,16 +422,26 @@ int h3zero_varint_stream_test();
 int h3zero_incoming_unidir_test();
 int h3zero_unidir_error_test();
 int h3zero_setting_error_test();
+int h3zero_priority_test();
 int h3zero_capsule_test();
+int h3zero_capsule_parse_test();
 int h3zero_client_data_test();
 int qpack_huffman_test();
 int qpack_huffman_base_test();
+int qpack_huffman_encode_test();
+int qpack_huffman_bench_test();
 int h3zero_parse_qpack_test();
+int h3zero_parse_qpack_borrowed_test();
 int h3zero_prepare_qpack_test();
 int h3zero_user_agent_test();
 int h3zero_uri_test();
 int h3zero_null_sni_test();
 int h3zero_qpack_fuzz_test();
+int h3zero_qpack_dynamic_test();
+int h3zero_qpack_blocked_test();
+int h3zero_qpack_no_block_test();
+int h3zero_qpack_eviction_test();
+int h3zero_qpack_error_test();
 int h3zero_stream_test();
 int h3zero_stream_fuzz_test();
 int parse_demo_scenario_test();
@@ -347,6 +451,7 @@ int h09_header_test();
 int generic_server_test();
 int tls_retry_token_test();
 int tls_retry_token_valid_test();
+int quic_group_test();
 int optimistic_ack_test();
 int optimistic_hole_test();
 int document_addresses_test();
@@ -356,22 +461,29 @@ int preferred_address_test();
 int preferred_address_dis_mig_test();
 int preferred_address_zero_test();
 int cid_for_lb_test();
+int cid_for_lb_batch_test();
+int lb_router_test();
 int cid_for_lb_cli_test();
 int retry_protection_vector_test();
 int retry_protection_v2_test();
 int test_copy_for_retransmit();
 int dataqueue_copy_test();
 int dataqueue_packet_test();
+int dataqueue_bucket_test();
 int bad_coalesce_test();
 int bad_cnxid_test();
 int stream_splay_test();
+int stream_index_test();
 int stream_output_test();
+int stream_scheduler_test();
+int stream_reassembly_ring_test();
 int stream_rank_test();
 int provide_stream_buffer_test();
 int not_before_cnxid_test();
 int send_stream_blocked_test();
 int stream_ack_test();
 int queue_network_input_test();
+int queue_network_view_test();
 int fastcc_test();
 int fastcc_jitter_test();
 int bbr_test();
@@ -397,7 +509,9 @@ int limited_cubic_test();
 int limited_bbr_test();
 int limited_batch_test();
 int limited_safe_test();
+int limited_recv_batch_test();
 int fast_nat_rebinding_test();
+int port_rebinding_fast_test();
 int datagram_test();
 int datagram_rt_test();
 int datagram_rt_skip_test();
@@ -407,6 +521,7 @@ int datagram_size_test();
 int datagram_small_test();
 int datagram_small_new_test();
 int datagram_small_packet_test();
+int datagram_ring_test();
 int datagram_wifi_test();
 int ddos_amplification_test();
 int ddos_amplification_0rtt_test();
@@ -428,8 +543,13 @@ int cwin_max_test();
 int initial_race_test();
 int pacing_test();
 int pacing_repeat_test();
+int pacing_precision_test();
 int chacha20_test();
 int cnx_limit_test();
+int cnx_wheel_test();
+int race_cnx_test();
+int egress_scheduler_test();
+int congestion_manager_test();
 int cert_verify_bad_cert_test();
 int cert_verify_bad_sni_test();
 int cert_verify_null_test();
@@ -508,15 +628,26 @@ int multipath_dg_af_test();
 int multipath_backup_test();
 int multipath_standup_test();
 int multipath_discovery_test();
+int multipath_sched_rtt_test();
+int multipath_sched_capacity_test();
+int multipath_sched_redundant_test();
+int multipath_lia_test();
+int multipath_olia_test();
+int multipath_balia_test();
 int multipath_qlog_test();
 int multipath_tunnel_test();
 int token_reuse_api_test();
+int token_registry_flood_test();
+int initial_rate_limit_test();
+int ticket_store_index_test();
+int shared_ticket_store_test();
 int get_hash_test();
 int get_tls_errors_test();
 int ech_config_test();
 int ech_config_p_test();
 int ech_e2e_test();
 int ech_grease_test();
+int ech_config_cache_test();
 int getter_test();
 int grease_quic_bit_test();
 int grease_quic_bit_one_way_test();
@@ -547,10 +678,22 @@ int config_quic_test();
 int config_usage_test();
 int h3zero_post_test();
 int h09_post_test();
+int h3zero_post_backpressure_test();
+int demo_pipeline_test();
 int demo_alpn_test();
 int demo_file_sanitize_test();
 int demo_file_access_test();
+int demo_file_encoding_test();
 int demo_server_file_test();
+int h3zero_file_cache_test();
+int h3zero_file_cache_serve_test();
+int h3zero_response_cache_test();
+int h3zero_response_cache_serve_test();
+int h3zero_path_router_test();
+int h3zero_stream_index_test();
+int h3zero_datagram_queue_test();
+int h3zero_cnx_pool_test();
+int connect_udp_test();
 int demo_ticket_test();
 int demo_error_test();
 int h3zero_satellite_test();
@@ -576,6 +719,7 @@ int picowt_baton_error_test();
 int picowt_baton_long_test();
 int picowt_baton_multi_test();
 int picowt_baton_random_test();
+int picowt_baton_bench_test();
 int picowt_baton_wrong_test();
 int picowt_baton_uri_test();
 int picowt_drain_test();
@@ -586,7 +730,10 @@ int quicperf_datagram_test();
 int quicperf_media_test();
 int quicperf_multi_test();
 int quicperf_overflow_test();
+int quicperf_load_test();
+int quicperf_histogram_test();
 int cplusplustest();
+int cplusplus_wrapper_test();
 
 #ifdef __cplusplus
 }
@@ -37,6 +37,7 @@ extern "C" {
 #define PICOQUIC_TEST_ALPN "picoquic-test"
 #define PICOQUIC_TEST_WRONG_ALPN "picoquic-bla-bla"
 #define PICOQUIC_TEST_MAX_TEST_STREAMS 100
+#define PICOQUIC_TEST_RECEIVE_BATCH_MAX 16
 
 #define RANDOM_PUBLIC_TEST_SEED 0xDEADBEEFCAFEC001ull
 
@@ -162,6 +163,8 @@ typedef struct st_picoquic_test_endpoint_t {
     uint64_t prepare_cpu_time;
     uint64_t incoming_cpu_time;
     size_t packet_queue_max;
+    size_t receive_batch_max; /* If > 1, queued packets are submitted with picoquic_incoming_packets */
+    uint64_t nb_batched_packets; /* Packets submitted in batches of more than one */
     /* next time endpoint ready */
     uint64_t next_time_ready;
     /* last time client sent something */
@@ -570,7 +570,7 @@ int picoqinq_test_sim_step(struct st_picoqinq_test_ctx_t* test_ctx)
 
     /* Find next arrival or departure time */
     for (int i=0; i< PICOQINQ_SIM_NB_CTX; i++){
-        if (test_ctx->qctx[i]->pending_stateless_packet != NULL) {
+        if (picoquic_has_pending_stateless_packet(test_ctx->qctx[i])) {
             selected_ctx = i;
             is_stateless = 1;
             next_time = test_ctx->simulated_time;
@@ -639,7 +639,7 @@ int picoqinq_test_sim_step(struct st_picoqinq_test_ctx_t* test_ctx)
                     memcpy(packet->bytes, sp->bytes, sp->length);
                     packet->length = sp->length;
                 }
-                picoquic_delete_stateless_packet(sp);
+                picoquic_delete_stateless_packet(test_ctx->qctx[selected_ctx], sp);
             }
         }
         else if (test_ctx->qctx[selected_ctx]->cnx_wake_first == NULL) {
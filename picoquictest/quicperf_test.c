@@ -702,3 +702,297 @@ int quicperf_overflow_test()
 
     return quicperf_e2e_test(0xf1, overflow_scenario, 6000000, 4, overflow_target);
 }
+
+/* Test of the load generator. A client context opens connections to a
+ * server context according to the arrival model, over a pair of simulated
+ * links, and the statistics are checked after the last connection ends.
+ */
+static const uint8_t quicperf_load_ticket_key[32] = {
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+};
+
+static int quicperf_load_test_arrival(picoquic_quic_t* quic, picoquictest_sim_link_t* link, uint64_t current_time)
+{
+    int ret = 0;
+    picoquictest_sim_packet_t* packet = picoquictest_sim_link_dequeue(link, current_time);
+
+    if (packet != NULL) {
+        ret = picoquic_incoming_packet(quic, packet->bytes, (uint32_t)packet->length,
+            (struct sockaddr*)&packet->addr_from, (struct sockaddr*)&packet->addr_to, 0, 0, current_time);
+        free(packet);
+    }
+    return ret;
+}
+
+static int quicperf_load_test_departure(picoquic_quic_t* quic, picoquictest_sim_link_t* link,
+    struct sockaddr* default_source, uint64_t current_time)
+{
+    int ret = 0;
+    picoquictest_sim_packet_t* packet = picoquictest_sim_link_create_packet();
+
+    if (packet == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_connection_id_t log_cid;
+        picoquic_cnx_t* last_cnx;
+        int if_index = 0;
+
+        ret = picoquic_prepare_next_packet(quic, current_time, packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length,
+            &packet->addr_to, &packet->addr_from, &if_index, &log_cid, &last_cnx);
+        if (ret == 0 && packet->length > 0) {
+            if (packet->addr_from.ss_family == AF_UNSPEC) {
+                picoquic_store_addr(&packet->addr_from, default_source);
+            }
+            picoquictest_sim_link_submit(link, packet, current_time);
+        }
+        else {
+            free(packet);
+        }
+    }
+    return ret;
+}
+
+static int quicperf_load_test_one(int is_poisson)
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    uint64_t time_out = 30000000;
+    int nb_steps = 0;
+    char test_server_cert_file[512];
+    char test_server_key_file[512];
+    char test_server_cert_store_file[512];
+    struct sockaddr_storage client_address;
+    picoquic_quic_t* qclient = NULL;
+    picoquic_quic_t* qserver = NULL;
+    picoquictest_sim_link_t* c_to_s_link = picoquictest_sim_link_create(0.01, 10000, NULL, 0, 0);
+    picoquictest_sim_link_t* s_to_c_link = picoquictest_sim_link_create(0.01, 10000, NULL, 0, 0);
+    quicperf_load_ctx_t* load_ctx = NULL;
+    quicperf_load_param_t param;
+
+    memset(&param, 0, sizeof(param));
+    param.scenario_text = "=b1:*2:100:20000;";
+    param.sni = PICOQUIC_TEST_SNI;
+    param.arrival_rate = 20;
+    param.max_concurrent = 8;
+    param.nb_connections = 10;
+    param.is_poisson = is_poisson;
+    param.random_seed = 0x10ad;
+
+    ret = picoquic_get_input_path(test_server_cert_file, sizeof(test_server_cert_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT);
+    if (ret == 0) {
+        ret = picoquic_get_input_path(test_server_key_file, sizeof(test_server_key_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY);
+    }
+    if (ret == 0) {
+        ret = picoquic_get_input_path(test_server_cert_store_file, sizeof(test_server_cert_store_file), picoquic_solution_dir, PICOQUIC_TEST_FILE_CERT_STORE);
+    }
+    if (ret == 0 && (c_to_s_link == NULL || s_to_c_link == NULL ||
+        picoquic_store_text_addr(&client_address, "10.0.0.2", 1234) != 0 ||
+        picoquic_store_text_addr(&param.server_address, "10.0.0.1", 4321) != 0 ||
+        (qclient = picoquic_create(8, NULL, NULL, test_server_cert_store_file, NULL, NULL, NULL, NULL, NULL, NULL,
+            simulated_time, &simulated_time, NULL, NULL, 0)) == NULL ||
+        (qserver = picoquic_create(8, test_server_cert_file, test_server_key_file, test_server_cert_store_file,
+            QUICPERF_ALPN, quicperf_callback, NULL, NULL, NULL, NULL, simulated_time, &simulated_time, NULL,
+            quicperf_load_ticket_key, sizeof(quicperf_load_ticket_key))) == NULL ||
+        (load_ctx = quicperf_load_create(qclient, &param, simulated_time)) == NULL)) {
+        ret = -1;
+    }
+
+    while (ret == 0 && !quicperf_load_is_done(load_ctx)) {
+        uint64_t next_time = quicperf_load_next_time(load_ctx);
+        uint64_t client_time = picoquic_get_next_wake_time(qclient, simulated_time);
+        uint64_t server_time = picoquic_get_next_wake_time(qserver, simulated_time);
+        uint64_t client_arrival = picoquictest_sim_link_next_arrival(s_to_c_link, next_time);
+        uint64_t server_arrival = picoquictest_sim_link_next_arrival(c_to_s_link, next_time);
+
+        if (client_time < next_time) {
+            next_time = client_time;
+        }
+        if (server_time < next_time) {
+            next_time = server_time;
+        }
+        if (client_arrival < next_time) {
+            next_time = client_arrival;
+        }
+        if (server_arrival < next_time) {
+            next_time = server_arrival;
+        }
+        if (next_time > simulated_time) {
+            simulated_time = next_time;
+        }
+        if (simulated_time > time_out || ++nb_steps > 1000000) {
+            DBG_PRINTF("Load test not done after %d steps, %" PRIu64 " us", nb_steps, simulated_time);
+            ret = -1;
+        }
+        else if (client_arrival <= simulated_time) {
+            ret = quicperf_load_test_arrival(qclient, s_to_c_link, simulated_time);
+        }
+        else if (server_arrival <= simulated_time) {
+            ret = quicperf_load_test_arrival(qserver, c_to_s_link, simulated_time);
+        }
+        else if (client_time <= simulated_time) {
+            ret = quicperf_load_test_departure(qclient, c_to_s_link, (struct sockaddr*)&client_address, simulated_time);
+        }
+        else if (server_time <= simulated_time) {
+            ret = quicperf_load_test_departure(qserver, s_to_c_link, (struct sockaddr*)&param.server_address, simulated_time);
+        }
+        if (ret == 0) {
+            /* Collects the connections that ended, and processes the arrivals */
+            ret = quicperf_load_step(load_ctx, simulated_time);
+        }
+    }
+
+    if (ret == 0) {
+        if (load_ctx->nb_arrivals != param.nb_connections || load_ctx->nb_refused != 0 ||
+            load_ctx->nb_completed != param.nb_connections || load_ctx->nb_failed != 0) {
+            DBG_PRINTF("Arrivals %" PRIu64 ", refused %" PRIu64 ", completed %" PRIu64 ", failed %" PRIu64,
+                load_ctx->nb_arrivals, load_ctx->nb_refused, load_ctx->nb_completed, load_ctx->nb_failed);
+            ret = -1;
+        }
+        else if (load_ctx->nb_handshakes != param.nb_connections || load_ctx->nb_zero_rtt == 0) {
+            DBG_PRINTF("Handshakes %" PRIu64 ", zero rtt %" PRIu64, load_ctx->nb_handshakes, load_ctx->nb_zero_rtt);
+            ret = -1;
+        }
+        else if (load_ctx->nb_requests != 2 * param.nb_connections || load_ctx->request_latency.count != 2 * param.nb_connections ||
+            load_ctx->data_received != 2 * param.nb_connections * 20000) {
+            DBG_PRINTF("Requests %" PRIu64 ", latencies %" PRIu64 ", received %" PRIu64,
+                load_ctx->nb_requests, load_ctx->request_latency.count, load_ctx->data_received);
+            ret = -1;
+        }
+        else if (quicperf_load_latency_percentile(load_ctx, 0) < 20000 ||
+            quicperf_load_latency_percentile(load_ctx, 50) > quicperf_load_latency_percentile(load_ctx, 99) ||
+            quicperf_load_latency_percentile(load_ctx, 100) > 1000000) {
+            /* Each request takes at least one round trip */
+            DBG_PRINTF("Unexpected latencies, min %" PRIu64 ", max %" PRIu64,
+                quicperf_load_latency_percentile(load_ctx, 0), quicperf_load_latency_percentile(load_ctx, 100));
+            ret = -1;
+        }
+    }
+
+    quicperf_load_delete(load_ctx);
+    if (qclient != NULL) {
+        picoquic_free(qclient);
+    }
+    if (qserver != NULL) {
+        picoquic_free(qserver);
+    }
+    if (c_to_s_link != NULL) {
+        picoquictest_sim_link_delete(c_to_s_link);
+    }
+    if (s_to_c_link != NULL) {
+        picoquictest_sim_link_delete(s_to_c_link);
+    }
+    return ret;
+}
+
+int quicperf_load_test()
+{
+    int ret = quicperf_load_test_one(0);
+
+    if (ret == 0) {
+        ret = quicperf_load_test_one(1);
+    }
+    return ret;
+}
+
+/* Check the precision of the latency histograms, and the JSON report.
+ */
+int quicperf_histogram_test()
+{
+    int ret = 0;
+    quicperf_histogram_t* histogram = (quicperf_histogram_t*)malloc(sizeof(quicperf_histogram_t));
+    quicperf_ctx_t* ctx = quicperf_create_ctx("=b1:*2:100:20000; =v1:s30:n300:2000;", NULL);
+    char const* json_file_name = "quicperf_histogram_test.json";
+    FILE* F = NULL;
+
+    if (histogram == NULL || ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        const double percentiles[] = { 1, 50, 90, 99, 99.9 };
+
+        memset(histogram, 0, sizeof(quicperf_histogram_t));
+        for (uint64_t v = 1; v <= 100000; v++) {
+            quicperf_histogram_add(histogram, v);
+        }
+        if (histogram->count != 100000 || histogram->min != 1 || histogram->max != 100000 ||
+            quicperf_histogram_percentile(histogram, 0) != 1 ||
+            quicperf_histogram_percentile(histogram, 100) != 100000) {
+            DBG_PRINTF("Unexpected count %" PRIu64 ", min %" PRIu64 ", max %" PRIu64,
+                histogram->count, histogram->min, histogram->max);
+            ret = -1;
+        }
+        for (size_t i = 0; ret == 0 && i < sizeof(percentiles) / sizeof(double); i++) {
+            uint64_t expected = (uint64_t)(percentiles[i] * 1000);
+            uint64_t value = quicperf_histogram_percentile(histogram, percentiles[i]);
+
+            if (value < expected || value > expected + expected / 32) {
+                DBG_PRINTF("Percentile %f: %" PRIu64 " instead of %" PRIu64, percentiles[i], value, expected);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Small values are exact, very large values land in the last bucket */
+        memset(histogram, 0, sizeof(quicperf_histogram_t));
+        quicperf_histogram_add(histogram, 17);
+        quicperf_histogram_add(histogram, 17);
+        quicperf_histogram_add(histogram, UINT64_MAX);
+        if (quicperf_histogram_percentile(histogram, 50) != 17 ||
+            histogram->buckets[QUICPERF_HISTOGRAM_NB_BUCKETS - 1] != 1 ||
+            quicperf_histogram_percentile(histogram, 99) != UINT64_MAX) {
+            DBG_PRINTF("%s", "Unexpected percentiles of extreme values");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        for (uint64_t v = 1; v <= 100; v++) {
+            quicperf_histogram_add(&ctx->reports[0].latency, 1000 * v);
+        }
+        ctx->reports[1].nb_frames_received = 1;
+        quicperf_histogram_add(&ctx->reports[1].latency, 2500);
+        if ((F = picoquic_file_open(json_file_name, "w")) == NULL) {
+            DBG_PRINTF("Cannot open %s", json_file_name);
+            ret = -1;
+        }
+        else {
+            ret = quicperf_print_json_report(F, ctx);
+            F = picoquic_file_close(F);
+        }
+    }
+
+    if (ret == 0) {
+        char buffer[1024];
+        size_t nb_read = 0;
+        char const* expected[] = {
+            "\"type\": \"batch\", \"repeat\": 2, \"latency\": { \"count\": 100, \"min\": 1000, \"mean\": 50500, \"max\": 100000, \"p50\": 50",
+            "\"id\": \"v1\", \"type\": \"stream\", \"repeat\": 1, \"frames_expected\": 300, \"frames_received\": 1",
+            "\"p99_9\": 2500 }" };
+
+        if ((F = picoquic_file_open(json_file_name, "r")) == NULL) {
+            ret = -1;
+        }
+        else {
+            nb_read = fread(buffer, 1, sizeof(buffer) - 1, F);
+            buffer[nb_read] = 0;
+            F = picoquic_file_close(F);
+        }
+        for (size_t i = 0; ret == 0 && i < sizeof(expected) / sizeof(char const*); i++) {
+            if (strstr(buffer, expected[i]) == NULL) {
+                DBG_PRINTF("Cannot find <%s> in <%s>", expected[i], buffer);
+                ret = -1;
+            }
+        }
+    }
+
+    if (histogram != NULL) {
+        free(histogram);
+    }
+    if (ctx != NULL) {
+        quicperf_delete_ctx(ctx);
+    }
+    return ret;
+}
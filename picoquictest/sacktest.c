@@ -131,7 +131,7 @@ int check_ack_ranges(picoquic_sack_list_t* sack_list)
             else if (sack->nb_times_sent[r] < PICOQUIC_MAX_ACK_RANGE_REPEAT) {
                 range_sum[sack->nb_times_sent[r]] += 1;
             }
-            sack = picoquic_sack_next_item(sack);
+            sack = picoquic_sack_next_item(sack_list, sack);
         }
 
         for (int i = 0; ret == 0 && i < PICOQUIC_MAX_ACK_RANGE_REPEAT; i++) {
@@ -621,6 +621,76 @@ int ackrange_test()
 }
 
 
+/* Verify the sorted array behind the sack list: growth from the inline
+ * items to allocated memory, insertion in the middle, merging of ranges,
+ * and removal of expired ranges by the horizon.
+ */
+int sack_list_array_test()
+{
+    int ret = 0;
+    picoquic_sack_list_t sack0;
+
+    picoquic_sack_list_init(&sack0);
+
+    /* Create 10 ranges, more than the inline capacity */
+    for (uint64_t pn = 0; ret == 0 && pn < 40; pn += 4) {
+        ret = picoquic_update_sack_list(&sack0, pn, pn, pn);
+    }
+    if (ret == 0 && (picoquic_sack_list_size(&sack0) != 10 || sack0.items == NULL)) {
+        DBG_PRINTF("Expected 10 allocated ranges, got %" PRIst, picoquic_sack_list_size(&sack0));
+        ret = -1;
+    }
+    /* Insert a range in the middle, then merge it with both neighbors */
+    if (ret == 0) {
+        ret = picoquic_update_sack_list(&sack0, 10, 10, 40);
+    }
+    if (ret == 0 && picoquic_sack_list_size(&sack0) != 11) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = picoquic_update_sack_list(&sack0, 9, 11, 41);
+    }
+    if (ret == 0 && (picoquic_sack_list_size(&sack0) != 9 ||
+        picoquic_sack_find_range_below_number(&sack0, NULL, 12) == NULL ||
+        picoquic_sack_find_range_below_number(&sack0, NULL, 12)->start_of_sack_range != 8 ||
+        picoquic_sack_find_range_below_number(&sack0, NULL, 12)->end_of_sack_range != 12)) {
+        DBG_PRINTF("%s", "Ranges 8, 10 and 12 not merged");
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = check_ack_ranges(&sack0);
+    }
+    /* Retire all the ranges, and let the horizon remove the old ones */
+    if (ret == 0) {
+        picoquic_sack_item_t* sack = picoquic_sack_first_item(&sack0);
+        while (sack != NULL) {
+            for (int r = 0; r < 2; r++) {
+                while (sack->nb_times_sent[r] < PICOQUIC_MAX_ACK_RANGE_REPEAT) {
+                    picoquic_sack_item_record_sent(&sack0, sack, r);
+                }
+            }
+            sack = picoquic_sack_next_item(&sack0, sack);
+        }
+        sack0.horizon_delay = 10;
+        picoquic_update_ack_horizon(&sack0, 35);
+        /* The ranges 0 and 4 are removed. The merged range 8-12 was
+         * modified at time 40, which stops the removal. */
+        if (picoquic_sack_list_size(&sack0) != 7 || picoquic_sack_list_first(&sack0) != 8 ||
+            sack0.ack_horizon != 5) {
+            DBG_PRINTF("After horizon, %" PRIst " ranges, first %" PRIu64 ", horizon %" PRIu64,
+                picoquic_sack_list_size(&sack0), picoquic_sack_list_first(&sack0), sack0.ack_horizon);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = check_ack_ranges(&sack0);
+    }
+
+    picoquic_sack_list_free(&sack0);
+
+    return ret;
+}
+
 /* Examine what happens when the packets are received in disorder. In this test, even packets (0, 2..)
  * are received through a high latency path, odd packets (1..3) through a low latency path, and the
  * ack-of-ack is sent after 32 packets are received. The goal is to verify that ack ranges are
@@ -792,3 +862,168 @@ int ack_horizon_test()
     int ret = ack_disorder_test_one(ACK_HORIZON_LOG, 1000000, 196.0);
     return ret;
 }
+
+/* Verify that the ACK encoder stops scanning at the ranges that have been
+ * sent often enough, so that in order arrivals only update the top range,
+ * and that ranges modified below the scan floor are sent again.
+ */
+static int ack_scan_num_blocks(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* num_block)
+{
+    int ret = 0;
+    uint64_t largest = 0;
+    uint64_t ack_delay = 0;
+
+    if (bytes == NULL || bytes >= bytes_max || bytes[0] != picoquic_frame_type_ack ||
+        (bytes = picoquic_frames_varint_decode(bytes + 1, bytes_max, &largest)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, &ack_delay)) == NULL ||
+        (bytes = picoquic_frames_varint_decode(bytes, bytes_max, num_block)) == NULL) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int ack_scan_floor_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_packet_context_enum pc = picoquic_packet_context_application;
+    picoquic_sack_list_t* sack_list;
+    uint8_t bytes[1024];
+    uint64_t num_block = 0;
+    int nb_acks = 0;
+
+    if (picoquic_test_set_minimal_cnx(&quic, &cnx) != 0) {
+        return -1;
+    }
+    cnx->ack_ctx[pc].sending_ecn_ack = 0;
+    sack_list = &cnx->ack_ctx[pc].sack_list;
+
+    /* Create 300 ranges, one packet every two. */
+    for (uint64_t pn = 0; ret == 0 && pn < 600; pn += 2) {
+        ret = picoquic_record_pn_received(cnx, pc, cnx->first_local_cnxid_list->local_cnxid_first, pn, 0);
+    }
+    /* Send ACKs until all the ranges below the top one are retired */
+    while (ret == 0 && sack_list->ack_scan_floor[0] < 597) {
+        int more_data = 0;
+        uint8_t* bytes_next = picoquic_format_ack_frame(cnx, bytes, bytes + sizeof(bytes), &more_data, 0, pc, 0);
+        if (bytes_next == bytes || ++nb_acks > 100) {
+            DBG_PRINTF("Scan floor %" PRIu64 " after %d acks", sack_list->ack_scan_floor[0], nb_acks);
+            ret = -1;
+        }
+    }
+    /* In order arrival only extends the top range */
+    if (ret == 0) {
+        int more_data = 0;
+        uint8_t* bytes_next;
+        ret = picoquic_record_pn_received(cnx, pc, cnx->first_local_cnxid_list->local_cnxid_first, 599, 0);
+        if (ret == 0) {
+            bytes_next = picoquic_format_ack_frame(cnx, bytes, bytes + sizeof(bytes), &more_data, 0, pc, 0);
+            if (ack_scan_num_blocks(bytes, bytes_next, &num_block) != 0 || num_block != 0) {
+                DBG_PRINTF("In order ACK, num_block: %" PRIu64 ", expected 0", num_block);
+                ret = -1;
+            }
+        }
+    }
+    /* Filling a hole below the floor merges two ranges, which must be sent again */
+    if (ret == 0) {
+        int more_data = 0;
+        uint8_t* bytes_next;
+        ret = picoquic_record_pn_received(cnx, pc, cnx->first_local_cnxid_list->local_cnxid_first, 591, 0);
+        if (ret == 0 && sack_list->ack_scan_floor[0] != 590) {
+            DBG_PRINTF("Scan floor: %" PRIu64 ", expected 590", sack_list->ack_scan_floor[0]);
+            ret = -1;
+        }
+        if (ret == 0) {
+            bytes_next = picoquic_format_ack_frame(cnx, bytes, bytes + sizeof(bytes), &more_data, 0, pc, 0);
+            if (ack_scan_num_blocks(bytes, bytes_next, &num_block) != 0 || num_block != 1) {
+                DBG_PRINTF("ACK after hole filled, num_block: %" PRIu64 ", expected 1", num_block);
+                ret = -1;
+            }
+        }
+    }
+
+    picoquic_test_delete_minimal_cnx(&quic, &cnx);
+
+    return ret;
+}
+
+/* Receive one packet every two on a long connection, so every packet
+ * creates a range and none is ever acknowledged by the peer. Check that
+ * the number of tracked ranges stays close to the cap, that ranges are
+ * only dropped after being sent PICOQUIC_MIN_ACK_RANGE_REPEAT times, that
+ * the accounting of ranges sent remains correct, and that the packets
+ * below the horizon are reported as already received.
+ */
+int ack_range_cap_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_packet_context_enum pc = picoquic_packet_context_application;
+    picoquic_local_cnxid_t* l_cid;
+    picoquic_sack_list_t* sack_list;
+    uint8_t bytes[1024];
+    const uint64_t pn_max = 8 * PICOQUIC_MAX_ACK_RANGES_TRACKED;
+
+    if (picoquic_test_set_minimal_cnx(&quic, &cnx) != 0) {
+        return -1;
+    }
+    cnx->ack_ctx[pc].sending_ecn_ack = 0;
+    sack_list = &cnx->ack_ctx[pc].sack_list;
+    l_cid = cnx->first_local_cnxid_list->local_cnxid_first;
+
+    for (uint64_t pn = 0; ret == 0 && pn < pn_max; pn += 2) {
+        /* Find the lowest range not yet sent enough times */
+        uint64_t lowest_unsent = UINT64_MAX;
+        picoquic_sack_item_t* sack = picoquic_sack_first_item(sack_list);
+
+        while (sack != NULL) {
+            if (sack->nb_times_sent[0] < PICOQUIC_MIN_ACK_RANGE_REPEAT) {
+                lowest_unsent = sack->start_of_sack_range;
+                break;
+            }
+            sack = picoquic_sack_next_item(sack_list, sack);
+        }
+        ret = picoquic_record_pn_received(cnx, pc, l_cid, pn, 0);
+        if (ret == 0 && sack_list->ack_horizon > lowest_unsent) {
+            DBG_PRINTF("Range %" PRIu64 " dropped before being sent, horizon %" PRIu64,
+                lowest_unsent, sack_list->ack_horizon);
+            ret = -1;
+        }
+        if (ret == 0 && picoquic_sack_list_size(sack_list) > PICOQUIC_MAX_ACK_RANGES_TRACKED +
+            PICOQUIC_MAX_ACK_RANGES_TRACKED / 8) {
+            DBG_PRINTF("%" PRIst " ranges tracked after packet %" PRIu64, picoquic_sack_list_size(sack_list), pn);
+            ret = -1;
+        }
+        if (ret == 0 && (pn % 8) == 0) {
+            int more_data = 0;
+            (void)picoquic_format_ack_frame(cnx, bytes, bytes + sizeof(bytes), &more_data, 0, pc, 0);
+            ret = check_ack_ranges(sack_list);
+        }
+    }
+
+    if (ret == 0) {
+        uint64_t horizon = sack_list->ack_horizon;
+
+        if (horizon == 0 || picoquic_sack_list_first(sack_list) < horizon) {
+            DBG_PRINTF("Horizon %" PRIu64 ", first range %" PRIu64, horizon, picoquic_sack_list_first(sack_list));
+            ret = -1;
+        }
+        else if (!picoquic_is_pn_already_received(cnx, pc, l_cid, 0) ||
+            !picoquic_is_pn_already_received(cnx, pc, l_cid, horizon - 1) ||
+            picoquic_is_pn_already_received(cnx, pc, l_cid, pn_max - 1)) {
+            DBG_PRINTF("Wrong duplicate detection around horizon %" PRIu64, horizon);
+            ret = -1;
+        }
+        else if (picoquic_record_pn_received(cnx, pc, l_cid, pn_max - 1, 0) != 0 ||
+            !picoquic_is_pn_already_received(cnx, pc, l_cid, pn_max - 1)) {
+            DBG_PRINTF("%s", "Packet above the horizon not recorded");
+            ret = -1;
+        }
+    }
+
+    picoquic_test_delete_minimal_cnx(&quic, &cnx);
+
+    return ret;
+}
@@ -38,6 +38,9 @@
 
 static uint8_t test_frame_type_padding[] = { 0, 0, 0 };
 
+/* Long run of padding, skipped eight bytes at a time */
+static uint8_t test_frame_type_padding_run[37] = { 0 };
+
 static uint8_t test_frame_type_reset_stream[] = {
     picoquic_frame_type_reset_stream,
     17,
@@ -371,6 +374,7 @@ static uint8_t test_frame_observed_address_v6[] = {
 
 test_skip_frames_t test_skip_list[] = {
     TEST_SKIP_ITEM("padding", test_frame_type_padding, 1, 0, 0, 0, 0, 0),
+    TEST_SKIP_ITEM("padding_run", test_frame_type_padding_run, 1, 0, 0, 0, 0, 0),
     TEST_SKIP_ITEM("reset_stream", test_frame_type_reset_stream, 0, 0, 3, 0, 0, 3),
     TEST_SKIP_ITEM("connection_close", test_type_connection_close, 0, 0, 3, 0, 0, 3),
     TEST_SKIP_ITEM("application_close", test_type_application_close, 0, 0, 3, 0, 0, 2),
@@ -2372,6 +2376,34 @@ int cnxid_stash_test()
             }
         }
 
+        /* Find by sequence number in mode 2, including a sequence that collides in the ring */
+        if (ret == 0 && test_mode == 2) {
+            picoquic_remote_cnxid_stash_t* stash = cnx->first_remote_cnxid_stash;
+            uint8_t collide_id[4] = { 7, 7, 7, 7 };
+            uint8_t collide_secret[PICOQUIC_RESET_SECRET_SIZE];
+            uint64_t collide_sequence = stash_test_case[0].sequence + stash->cnxid_ring_size;
+
+            for (size_t i = 0; ret == 0 && i < nb_stash_test_case; i++) {
+                ret = cnxid_stash_compare(test_mode, picoquic_find_cnxid_in_stash(stash, stash_test_case[i].sequence), i);
+            }
+
+            memset(collide_secret, 7, sizeof(collide_secret));
+            if (ret == 0 && (picoquic_stash_remote_cnxid(cnx, 0, 0, collide_sequence, sizeof(collide_id),
+                collide_id, collide_secret, &stashed) != 0 || stashed == NULL ||
+                stash->nb_cnxid_not_indexed != 1 || picoquic_find_cnxid_in_stash(stash, collide_sequence) != stashed)) {
+                DBG_PRINTF("Test %d, cannot find colliding cnxid %" PRIu64 ".\n", test_mode, collide_sequence);
+                ret = -1;
+            }
+            if (ret == 0) {
+                (void)picoquic_remove_cnxid_from_stash(cnx, stash, stashed, NULL);
+                if (stash->nb_cnxid_not_indexed != 0 || picoquic_find_cnxid_in_stash(stash, collide_sequence) != NULL ||
+                    picoquic_find_cnxid_in_stash(stash, stash_test_case[0].sequence) == NULL) {
+                    DBG_PRINTF("Test %d, colliding cnxid not removed.\n", test_mode);
+                    ret = -1;
+                }
+            }
+        }
+
         /* Dequeue all in mode 1, verify order */
         if (test_mode == 1) {
             for (size_t i = 0; ret == 0 && i < nb_stash_test_case; i++) {
@@ -3280,6 +3312,205 @@ int dataqueue_packet_test()
     return ret;
 }
 
+/* Data repeat queue test: queue lost packets of streams at different priorities,
+ * in random order, and verify that the queue is sorted by priority, stream and
+ * offset, that each priority bucket is correctly delimited, and that this
+ * remains true as packets are removed from the front, middle or end.
+ */
+typedef struct st_dataqueue_bucket_key_t {
+    uint64_t stream_id;
+    uint64_t offset;
+} dataqueue_bucket_key_t;
+
+static int dataqueue_bucket_check(picoquic_cnx_t* cnx, const dataqueue_bucket_key_t* expected, size_t nb_expected)
+{
+    int ret = 0;
+    picoquic_packet_t* packet = picoquic_first_data_repeat_packet(cnx);
+    picoquic_packet_t* previous = NULL;
+    picoquic_packet_t* head = NULL;
+    size_t nb_found = 0;
+
+    while (ret == 0 && packet != NULL) {
+        if (nb_found >= nb_expected || packet->data_repeat_stream_id != expected[nb_found].stream_id ||
+            packet->data_repeat_stream_offset != expected[nb_found].offset) {
+            DBG_PRINTF("Unexpected packet %zu in queue, stream %" PRIu64 ", offset %" PRIu64,
+                nb_found, packet->data_repeat_stream_id, packet->data_repeat_stream_offset);
+            ret = -1;
+        }
+        else if (packet->data_repeat_previous != previous || !packet->is_queued_for_data_repeat) {
+            DBG_PRINTF("Packet %zu not properly linked", nb_found);
+            ret = -1;
+        }
+        else {
+            if (previous == NULL || previous->data_repeat_priority != packet->data_repeat_priority) {
+                if (previous != NULL && previous->data_repeat_priority > packet->data_repeat_priority) {
+                    DBG_PRINTF("Priority buckets out of order at packet %zu", nb_found);
+                    ret = -1;
+                }
+                head = packet;
+            }
+            if (ret == 0 && (packet->data_repeat_next == NULL ||
+                packet->data_repeat_next->data_repeat_priority != packet->data_repeat_priority) &&
+                head->data_repeat_bucket_last != packet) {
+                DBG_PRINTF("Bucket ending at packet %zu not delimited", nb_found);
+                ret = -1;
+            }
+            previous = packet;
+            packet = packet->data_repeat_next;
+            nb_found++;
+        }
+    }
+
+    if (ret == 0 && nb_found != nb_expected) {
+        DBG_PRINTF("Found %zu packets in queue instead of %zu", nb_found, nb_expected);
+        ret = -1;
+    }
+
+    for (uint64_t stream_id = 0; ret == 0 && stream_id <= 8; stream_id += 4) {
+        picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+        if (stream == NULL || (stream->data_repeat_hint != NULL &&
+            (!stream->data_repeat_hint->is_queued_for_data_repeat ||
+                stream->data_repeat_hint->data_repeat_stream_id != stream_id))) {
+            DBG_PRINTF("Bad data repeat hint for stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static picoquic_packet_t* dataqueue_bucket_find(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t offset)
+{
+    picoquic_packet_t* packet = picoquic_first_data_repeat_packet(cnx);
+
+    while (packet != NULL &&
+        (packet->data_repeat_stream_id != stream_id || packet->data_repeat_stream_offset != offset)) {
+        packet = packet->data_repeat_next;
+    }
+
+    return packet;
+}
+
+int dataqueue_bucket_test()
+{
+    picoquic_quic_t* qtest = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    const dataqueue_bucket_key_t queued[] = {
+        { 8, 1000 }, { 0, 2000 }, { 4, 0 }, { 0, 0 }, { 8, 0 }, { 4, 1000 }, { 0, 1000 }, { 4, 500 } };
+    const dataqueue_bucket_key_t sorted[] = {
+        { 4, 0 }, { 4, 500 }, { 4, 1000 }, { 0, 0 }, { 0, 1000 }, { 0, 2000 }, { 8, 0 }, { 8, 1000 } };
+    const dataqueue_bucket_key_t after_middle[] = {
+        { 4, 0 }, { 4, 500 }, { 4, 1000 }, { 0, 0 }, { 0, 2000 }, { 8, 0 }, { 8, 1000 } };
+    const dataqueue_bucket_key_t after_ends[] = {
+        { 4, 500 }, { 4, 1000 }, { 0, 0 }, { 0, 2000 }, { 8, 0 } };
+    const dataqueue_bucket_key_t after_bucket[] = {
+        { 4, 500 }, { 4, 1000 }, { 8, 0 } };
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+
+    qtest = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+    if (qtest == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(qtest,
+            picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr*) & saddr,
+            simulated_time, 0, "test-sni", "test-alpn", 1);
+        if (cnx == NULL) {
+            ret = -1;
+        }
+    }
+
+    /* Create the streams, with stream 4 more urgent than 0, and 0 more urgent than 8 */
+    for (uint64_t stream_id = 0; ret == 0 && stream_id <= 8; stream_id += 4) {
+        uint8_t new_bytes[256];
+        memset(new_bytes, 0, sizeof(new_bytes));
+        if (picoquic_add_to_stream(cnx, stream_id, new_bytes, sizeof(new_bytes), 0) != 0 ||
+            picoquic_set_stream_priority(cnx, stream_id, (stream_id == 4) ? 2 : ((stream_id == 0) ? 8 : 12)) != 0) {
+            DBG_PRINTF("Cannot initialize stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < sizeof(queued) / sizeof(dataqueue_bucket_key_t); i++) {
+        picoquic_packet_t* packet = picoquic_create_packet(qtest);
+        if (packet == NULL) {
+            ret = -1;
+        }
+        else {
+            size_t bytes_max = packet->bytes_max;
+            (void)dataqueue_prepare_packet(packet, 1, 0, queued[i].stream_id, queued[i].offset, 256);
+            packet->bytes_max = bytes_max;
+            picoquic_queue_data_repeat_packet(cnx, packet);
+            if (!packet->is_queued_for_data_repeat) {
+                DBG_PRINTF("Packet %zu not queued", i);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        ret = dataqueue_bucket_check(cnx, sorted, sizeof(sorted) / sizeof(dataqueue_bucket_key_t));
+    }
+
+    if (ret == 0) {
+        /* Remove a packet in the middle of a bucket */
+        picoquic_dequeue_data_repeat_packet(cnx, dataqueue_bucket_find(cnx, 0, 1000));
+        ret = dataqueue_bucket_check(cnx, after_middle, sizeof(after_middle) / sizeof(dataqueue_bucket_key_t));
+    }
+
+    if (ret == 0) {
+        /* Remove the first packet of the queue, and the last one */
+        picoquic_dequeue_data_repeat_packet(cnx, picoquic_first_data_repeat_packet(cnx));
+        picoquic_dequeue_data_repeat_packet(cnx, dataqueue_bucket_find(cnx, 8, 1000));
+        ret = dataqueue_bucket_check(cnx, after_ends, sizeof(after_ends) / sizeof(dataqueue_bucket_key_t));
+    }
+
+    if (ret == 0) {
+        /* Empty the bucket in the middle */
+        picoquic_dequeue_data_repeat_packet(cnx, dataqueue_bucket_find(cnx, 0, 2000));
+        picoquic_dequeue_data_repeat_packet(cnx, dataqueue_bucket_find(cnx, 0, 0));
+        ret = dataqueue_bucket_check(cnx, after_bucket, sizeof(after_bucket) / sizeof(dataqueue_bucket_key_t));
+    }
+
+    if (ret == 0) {
+        /* Queue again in the emptied bucket, then empty the queue */
+        picoquic_packet_t* packet = picoquic_create_packet(qtest);
+        if (packet == NULL) {
+            ret = -1;
+        }
+        else {
+            const dataqueue_bucket_key_t requeued[] = { { 4, 500 }, { 4, 1000 }, { 0, 3000 }, { 8, 0 } };
+            size_t bytes_max = packet->bytes_max;
+            (void)dataqueue_prepare_packet(packet, 1, 0, 0, 3000, 256);
+            packet->bytes_max = bytes_max;
+            picoquic_queue_data_repeat_packet(cnx, packet);
+            ret = dataqueue_bucket_check(cnx, requeued, sizeof(requeued) / sizeof(dataqueue_bucket_key_t));
+        }
+        while (picoquic_first_data_repeat_packet(cnx) != NULL) {
+            picoquic_dequeue_data_repeat_packet(cnx, picoquic_first_data_repeat_packet(cnx));
+        }
+        if (ret == 0) {
+            ret = dataqueue_bucket_check(cnx, NULL, 0);
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (qtest != NULL) {
+        picoquic_free(qtest);
+    }
+    return ret;
+}
+
 /* Testing the sending of blocked frames */
 struct st_stream_blocked_test_t {
     uint64_t stream_id;
@@ -3424,7 +3655,7 @@ int send_stream_blocked_test()
     return ret;
 }
 
-int picoquic_queue_network_input(picoquic_quic_t * quic, picosplay_tree_t* tree, uint64_t consumed_offset,
+int picoquic_queue_network_input(picoquic_quic_t * quic, picoquic_cnx_t* cnx, picosplay_tree_t* tree, uint64_t consumed_offset,
     uint64_t stream_ofs, const uint8_t* bytes, size_t length, int is_last_frame, picoquic_stream_data_node_t* received_data, int* new_data_available);
 
 int64_t picoquic_stream_data_node_compare(void* l, void* r);
@@ -3464,7 +3695,7 @@ int queue_network_input_test()
     /* Fill 0..3 */
     if (ret == 0) {
         new_data_available = 0;
-        if ((ret = picoquic_queue_network_input(quic, tree, 0, 0, data, 4, 1, NULL,
+        if ((ret = picoquic_queue_network_input(quic, NULL, tree, 0, 0, data, 4, 1, NULL,
             &new_data_available)) != 0) {
             DBG_PRINTF("picoquic_queue_network_input(0, 0, 4) failed (%d)", ret);
         }
@@ -3477,7 +3708,7 @@ int queue_network_input_test()
     /* Fill 6..9 */
     if (ret == 0) {
         new_data_available = 0;
-        if ((ret = picoquic_queue_network_input(quic, tree, 0, 6, data + 6, 4, 1, NULL, &new_data_available)) != 0) {
+        if ((ret = picoquic_queue_network_input(quic, NULL, tree, 0, 6, data + 6, 4, 1, NULL, &new_data_available)) != 0) {
             DBG_PRINTF("picoquic_queue_network_input(0, 6, 4) failed (%d)", ret);
         } else if (new_data_available == 0) {
             DBG_PRINTF("new_data_available doesn't signal new data (%d)", new_data_available);
@@ -3488,7 +3719,7 @@ int queue_network_input_test()
     /* Fill the gap from 4..5 with a chunk from 2..7 */
     if (ret == 0) {
         new_data_available = 0;
-        if ((ret = picoquic_queue_network_input(quic, tree, 0, 2, data + 2, 6, 1, NULL, &new_data_available)) != 0) {
+        if ((ret = picoquic_queue_network_input(quic, NULL, tree, 0, 2, data + 2, 6, 1, NULL, &new_data_available)) != 0) {
             DBG_PRINTF("picoquic_queue_network_input(0, 2, 6) failed (%d)", ret);
         } else if (new_data_available == 0) {
             DBG_PRINTF("new_data_available signals new data (%d)", new_data_available);
@@ -3499,7 +3730,7 @@ int queue_network_input_test()
     /* No new data delivered by chunk 2..7 */
     if (ret == 0) {
         new_data_available = 0;
-        if ((ret = picoquic_queue_network_input(quic, tree, 0, 2, data, 6, 1, NULL, &new_data_available)) != 0) {
+        if ((ret = picoquic_queue_network_input(quic, NULL, tree, 0, 2, data, 6, 1, NULL, &new_data_available)) != 0) {
             DBG_PRINTF("picoquic_queue_network_input(0, 2, 6) failed (%d)", ret);
         }
 
@@ -3541,6 +3772,127 @@ int queue_network_input_test()
     return ret;
 }
 
+/* Verify that large chunks that are not the last frame in the packet are queued
+ * as views into the packet buffer instead of being copied, that the packet
+ * buffer is only recycled when the last view is deleted, and that the
+ * application can hold the buffer past the deletion of the views.
+ */
+int queue_network_view_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_stream_data_node_t* packet = NULL;
+    picoquic_stream_data_buffer_t* held = NULL;
+    int nb_outstanding = 0;
+    int new_data_available = 0;
+    struct sockaddr_in saddr;
+    const picoquic_connection_id_t initial_cid = { { 8, 9, 0, 1, 2, 3, 4, 5 }, 8 };
+    const picoquic_connection_id_t dest_cid = { { 16, 17, 18, 19, 20, 21, 22, 23 }, 8 };
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+    picosplay_tree_t* tree = picosplay_new_tree(
+        picoquic_stream_data_node_compare,
+        picoquic_stream_data_node_create,
+        picoquic_stream_data_node_delete,
+        picoquic_stream_data_node_value);
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    if (quic == NULL || tree == NULL) {
+        ret = -1;
+    }
+    else {
+        nb_outstanding = quic->nb_data_nodes_allocated - quic->nb_data_nodes_in_pool;
+        cnx = picoquic_create_cnx(quic, initial_cid, dest_cid, (struct sockaddr*)&saddr,
+            simulated_time, 0, "test-sni", "test-alpn", 1);
+        packet = picoquic_stream_data_node_alloc(quic);
+        if (cnx == NULL || packet == NULL) {
+            ret = -1;
+        }
+        else {
+            for (size_t i = 0; i < 1000; i++) {
+                packet->data[i] = (uint8_t)i;
+            }
+        }
+    }
+
+    /* Queue 600..999 and 200..499 as views, 0..99 as a copy */
+    if (ret == 0 && (
+        picoquic_queue_network_input(quic, cnx, tree, 0, 600, packet->data + 600, 400, 0, packet, &new_data_available) != 0 ||
+        picoquic_queue_network_input(quic, cnx, tree, 0, 0, packet->data, 100, 0, packet, &new_data_available) != 0 ||
+        picoquic_queue_network_input(quic, cnx, tree, 0, 200, packet->data + 200, 300, 0, packet, &new_data_available) != 0)) {
+        DBG_PRINTF("%s", "picoquic_queue_network_input failed");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        picoquic_stream_data_node_t* next = (picoquic_stream_data_node_t*)picosplay_first(tree);
+        const uint64_t expected_offset[3] = { 0, 200, 600 };
+        const int expected_view[3] = { 0, 1, 1 };
+
+        for (int i = 0; ret == 0 && i < 3; i++) {
+            if (next == NULL) {
+                DBG_PRINTF("Tree contains only %d chunks", i);
+                ret = -1;
+            }
+            else if (next->offset != expected_offset[i] ||
+                next->bytes[0] != (uint8_t)expected_offset[i] ||
+                (next->buffer_node == packet) != expected_view[i] ||
+                (next->bytes == packet->data + expected_offset[i]) != expected_view[i]) {
+                DBG_PRINTF("Unexpected chunk %d, offset %" PRIu64, i, next->offset);
+                ret = -1;
+            }
+            else {
+                next = (picoquic_stream_data_node_t*)picosplay_next(&next->stream_data_node);
+            }
+        }
+        if (ret == 0 && packet->nb_refs != 2) {
+            DBG_PRINTF("Packet buffer has %d refs instead of 2", packet->nb_refs);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Simulate the end of packet processing, then hold the buffer as if in a callback */
+        picoquic_stream_data_node_recycle(packet);
+        cnx->delivered_data_node = (picoquic_stream_data_node_t*)picosplay_last(tree);
+        held = picoquic_hold_stream_data(cnx);
+        cnx->delivered_data_node = NULL;
+        if (held != packet || packet->nb_refs != 2 || packet->cnx != NULL) {
+            DBG_PRINTF("%s", "Could not hold the packet buffer");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picosplay_empty_tree(tree);
+        if (packet->nb_refs != 0 || cnx->memory_used[picoquic_memory_stream_receive] != 0) {
+            DBG_PRINTF("Packet buffer has %d refs, %" PRIst " bytes charged", packet->nb_refs,
+                cnx->memory_used[picoquic_memory_stream_receive]);
+            ret = -1;
+        }
+        else {
+            picoquic_release_stream_data(held);
+            if (quic->nb_data_nodes_allocated - quic->nb_data_nodes_in_pool != nb_outstanding) {
+                DBG_PRINTF("%s", "Packet buffer was not recycled");
+                ret = -1;
+            }
+        }
+    }
+
+    if (tree != NULL) {
+        picosplay_empty_tree(tree);
+        free(tree);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
 #define QLOG_OVERFLOW_REF "picoquictest" PICOQUIC_FILE_SEPARATOR "app_msg_overflow_ref.qlog"
 static char const* qlog_overflow_bin = "0809000102030405.client.log";
 static char const* qlog_overflow_file = "0809000102030405.qlog";
@@ -19,10 +19,16 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 #include "picoquic.h"
 #include "picoquic_utils.h"
 #include "picoquictest_internal.h"
@@ -62,6 +68,20 @@ typedef struct st_sockloop_test_spec_t {
     int extra_socket_required;
     int prefer_extra_socket;
     int force_migration;
+    int batch_depth;
+    int use_io_uring;
+    int use_rio;
+    int use_select;
+    uint64_t txtime_horizon;
+    int zerocopy_pool_size;
+    int use_command_queue;
+    int use_receive_timestamps;
+    uint16_t metrics_port;
+    int use_io_provider;
+    uint64_t busy_poll_budget;
+    int pin_to_cpu;
+    int numa_local;
+    uint64_t timer_slack;
 } sockloop_test_spec_t;
 
 typedef struct st_sockloop_test_cb_t {
@@ -83,8 +103,29 @@ typedef struct st_sockloop_test_cb_t {
     picoquic_connection_id_t server_cid_before_migration;
     picoquic_connection_id_t client_cid_before_migration;
     picoquic_packet_loop_param_t* param;
+    int use_command_queue;
+    int nb_commands;
+    int metrics_scraped;
+    int nb_latency_reports;
+    uint64_t nb_prepare_reported;
+    uint64_t nb_spin_reported;
+    int affinity_verified;
+    uint64_t nb_time_checks;
 } sockloop_test_cb_t;
 
+/* Command posted to the network thread. The first one starts the client connection. */
+static void sockloop_test_command(picoquic_quic_t* quic, void* app_ctx)
+{
+    sockloop_test_cb_t* cb_ctx = (sockloop_test_cb_t*)app_ctx;
+#ifdef UNREFERENCED_PARAMETER
+    UNREFERENCED_PARAMETER(quic);
+#endif
+    if (cb_ctx->nb_commands++ == 0) {
+        int ret = picoquic_start_client_cnx(cb_ctx->test_ctx->cnx_client);
+        DBG_PRINTF("Starting the client connection, returns: %d", ret);
+    }
+}
+
 int sockloop_test_received_finished(picoquic_test_tls_api_ctx_t* test_ctx)
 {
     int ret = 0;
@@ -125,6 +166,43 @@ int sockloop_test_verify_extra_socket(picoquic_cnx_t* cnx_client, struct sockadd
     return ret;
 }
 
+/* Scrape the metrics endpoint from the network thread. This works because
+ * the endpoint runs in its own thread, and only reads published snapshots. */
+static int sockloop_test_scrape_metrics(uint16_t port, char* response, size_t response_max)
+{
+    int ret = 0;
+    SOCKET_TYPE fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_storage addr;
+    char const* request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    size_t length = 0;
+
+    if (fd == INVALID_SOCKET || picoquic_store_loopback_addr(&addr, AF_INET, port) != 0 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) != 0 ||
+        send(fd, request, (int)strlen(request), 0) != (int)strlen(request)) {
+        ret = -1;
+    }
+    else {
+        int nb_read;
+        while (length < response_max - 1 &&
+            (nb_read = (int)recv(fd, response + length, (int)(response_max - 1 - length), 0)) > 0) {
+            length += (size_t)nb_read;
+        }
+    }
+    response[length] = 0;
+    if (fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(fd);
+    }
+    if (ret == 0 && (strncmp(response, "HTTP/1.0 200 OK", 15) != 0 ||
+        strstr(response, "application/openmetrics-text") == NULL ||
+        strstr(response, "\npicoquic_packets_sent_total ") == NULL ||
+        strstr(response, "\n# EOF\n") == NULL)) {
+        DBG_PRINTF("Unexpected metrics response: %.80s", response);
+        ret = -1;
+    }
+
+    return ret;
+}
+
 int sockloop_test_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode, 
     void* callback_ctx, void * callback_arg)
 {
@@ -144,7 +222,26 @@ int sockloop_test_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode
                 if (cb_ctx->param->extra_socket_required) {
                     options->provide_alt_port = 1;
                 }
+                if (cb_ctx->param->metrics_port != 0 || cb_ctx->param->busy_poll_budget != 0) {
+                    options->do_latency_report = 1;
+                }
             }
+#if defined(__linux__)
+            if (cb_ctx->param->pin_to_cpu) {
+                /* The ready callback runs in the network thread, after it was pinned */
+                cpu_set_t cpu_set;
+
+                CPU_ZERO(&cpu_set);
+                if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0 &&
+                    CPU_COUNT(&cpu_set) == 1 && CPU_ISSET(cb_ctx->param->cpu_index, &cpu_set)) {
+                    cb_ctx->affinity_verified = 1;
+                }
+                else {
+                    DBG_PRINTF("Network thread is not pinned to CPU %d", cb_ctx->param->cpu_index);
+                    cb_ctx->affinity_verified = -1;
+                }
+            }
+#endif
             DBG_PRINTF("%s", "Waiting for packets.\n");
             break;
         }
@@ -239,20 +336,37 @@ int sockloop_test_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode
 
                 /* Start the download scenario */
             }
+            else if (ret == 0 && cb_ctx->established && cb_ctx->param != NULL &&
+                cb_ctx->param->metrics_port != 0 && !cb_ctx->metrics_scraped) {
+                char response[4096];
+
+                cb_ctx->metrics_scraped = 1;
+                ret = sockloop_test_scrape_metrics(cb_ctx->param->metrics_port, response, sizeof(response));
+            }
             break;
         case picoquic_packet_loop_port_update:
             break;
             /* TODO: consider adding the delay computation callback! */
         case picoquic_packet_loop_time_check: {
             packet_loop_time_check_arg_t* time_check_arg = (packet_loop_time_check_arg_t*) callback_arg;
+            cb_ctx->nb_time_checks++;
             if (time_check_arg->delta_t > 5000) {
                 time_check_arg->delta_t = 5000;
             }
             break;
         }
+        case picoquic_packet_loop_latency_report: {
+            picoquic_loop_latency_t* loop_latency = (picoquic_loop_latency_t*)callback_arg;
+            cb_ctx->nb_latency_reports++;
+            cb_ctx->nb_prepare_reported = loop_latency->prepare.nb_samples;
+            cb_ctx->nb_spin_reported = loop_latency->spin.nb_samples;
+            break;
+        }
         case picoquic_packet_loop_wake_up: {
-            ret = picoquic_start_client_cnx(cnx_client);
-            DBG_PRINTF("Starting the client connection, returns: %d", ret);
+            if (!cb_ctx->use_command_queue) {
+                ret = picoquic_start_client_cnx(cnx_client);
+                DBG_PRINTF("Starting the client connection, returns: %d", ret);
+            }
             break;
         }
         case picoquic_packet_loop_alt_port:
@@ -442,6 +556,130 @@ int sockloop_test_verify_migration(sockloop_test_cb_t * loop_cb, picoquic_cnx_t*
     return ret;
 }
 
+int sockloop_test_verify_latency_histogram(const picoquic_latency_histogram_t* histogram, char const* name)
+{
+    int ret = 0;
+    uint64_t nb_counted = 0;
+
+    for (int i = 0; i < PICOQUIC_LATENCY_NB_BUCKETS; i++) {
+        nb_counted += histogram->bucket[i];
+    }
+    if (histogram->nb_samples == 0 || nb_counted != histogram->nb_samples ||
+        histogram->max > histogram->sum) {
+        DBG_PRINTF("Unexpected %s histogram, %" PRIu64 " samples, %" PRIu64 " counted",
+            name, histogram->nb_samples, nb_counted);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* The same context runs the client and the server connections */
+int sockloop_test_verify_metrics(sockloop_test_cb_t* loop_cb, picoquic_quic_t* quic)
+{
+    int ret = 0;
+    picoquic_quic_metrics_t metrics;
+    picoquic_latency_histogram_t histogram = { 0 };
+    char text[256];
+    const uint64_t test_values[5] = { 0, 1, 3, 1024, 1ull << 30 };
+    const int test_buckets[5] = { 0, 0, 2, 10, PICOQUIC_LATENCY_NB_BUCKETS - 1 };
+
+    for (int i = 0; ret == 0 && i < 5; i++) {
+        picoquic_latency_histogram_add(&histogram, test_values[i]);
+        if (histogram.bucket[test_buckets[i]] == 0) {
+            DBG_PRINTF("Value %" PRIu64 " not counted in bucket %d", test_values[i], test_buckets[i]);
+            ret = -1;
+        }
+    }
+    if (ret == 0 && (histogram.nb_samples != 5 || histogram.max != (1ull << 30))) {
+        DBG_PRINTF("%s", "Unexpected latency histogram totals");
+        ret = -1;
+    }
+
+    picoquic_publish_quic_metrics(quic, picoquic_get_quic_time(quic));
+    if (ret != 0) {
+        /* Histogram test failed */
+    }
+    else if (!loop_cb->metrics_scraped) {
+        DBG_PRINTF("%s", "Metrics were not scraped");
+        ret = -1;
+    }
+    else if (picoquic_get_quic_metrics(quic, &metrics) != 0) {
+        DBG_PRINTF("%s", "Cannot read the metrics");
+        ret = -1;
+    }
+    else if (metrics.nb_connections_created != 2 || metrics.nb_handshakes != 2 ||
+        metrics.handshake_time.nb_samples != 2 || metrics.nb_active_connections > 2 ||
+        metrics.rtt.nb_samples == 0 || metrics.nb_packets_sent == 0 ||
+        metrics.nb_packets_received > metrics.nb_packets_sent ||
+        metrics.nb_datagrams_sent == 0 || metrics.nb_datagrams_sent > metrics.nb_packets_sent ||
+        metrics.nb_datagrams_received > metrics.nb_datagrams_sent ||
+        metrics.nb_bytes_sent < metrics.nb_datagrams_sent ||
+        metrics.nb_bytes_received > metrics.nb_bytes_sent || metrics.wake_list_size > 2) {
+        DBG_PRINTF("Unexpected metrics, %" PRIu64 " connections, %" PRIu64 " handshakes, %" PRIu64 " packets sent",
+            metrics.nb_connections_created, metrics.nb_handshakes, metrics.nb_packets_sent);
+        ret = -1;
+    }
+    else if (picoquic_format_openmetrics(&metrics, text, sizeof(text)) != 0) {
+        DBG_PRINTF("%s", "Metrics formatting does not detect overflow");
+        ret = -1;
+    }
+    else if (sockloop_test_verify_latency_histogram(&metrics.loop_latency.wait, "wait") != 0 ||
+        sockloop_test_verify_latency_histogram(&metrics.loop_latency.receive, "receive") != 0 ||
+        sockloop_test_verify_latency_histogram(&metrics.loop_latency.prepare, "prepare") != 0 ||
+        sockloop_test_verify_latency_histogram(&metrics.loop_latency.send, "send") != 0) {
+        ret = -1;
+    }
+    else if (loop_cb->nb_latency_reports == 0 || loop_cb->nb_prepare_reported == 0) {
+        DBG_PRINTF("%s", "Latency histograms were not reported");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Return the first CPU on which the test process is allowed to run */
+static int sockloop_test_first_cpu()
+{
+    int cpu_index = 0;
+#if defined(__linux__)
+    cpu_set_t cpu_set;
+
+    CPU_ZERO(&cpu_set);
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &cpu_set)) {
+                cpu_index = i;
+                break;
+            }
+        }
+    }
+#endif
+    return cpu_index;
+}
+
+/* The loop records one wake up each time a wait returns, and
+ * each wait is preceded by a time check. */
+int sockloop_test_verify_wakeups(sockloop_test_cb_t* loop_cb, picoquic_quic_t* quic)
+{
+    int ret = 0;
+    uint64_t nb_wakeups = 0;
+    uint64_t wakeups_per_second = 0;
+
+    picoquic_get_wakeup_stats(quic, &nb_wakeups, &wakeups_per_second);
+    if (nb_wakeups == 0) {
+        DBG_PRINTF("%s", "No wake up was recorded by the loop");
+        ret = -1;
+    }
+    else if (nb_wakeups > loop_cb->nb_time_checks) {
+        DBG_PRINTF("Recorded %" PRIu64 " wake ups for %" PRIu64 " waits",
+            nb_wakeups, loop_cb->nb_time_checks);
+        ret = -1;
+    }
+
+    return ret;
+}
+
 int sockloop_test_one(sockloop_test_spec_t *spec)
 {
     int ret = 0;
@@ -465,6 +703,7 @@ int sockloop_test_one(sockloop_test_spec_t *spec)
     }
     if (ret == 0) {
         picoquic_set_qlog(test_ctx->qserver, ".");
+        picoquic_set_timer_slack(test_ctx->qserver, spec->timer_slack);
     }
     /* Create connection context */
     if (ret == 0) {
@@ -522,10 +761,29 @@ int sockloop_test_one(sockloop_test_spec_t *spec)
             param.simulate_eio = spec->simulate_eio;
             param.extra_socket_required = spec->extra_socket_required;
             param.prefer_extra_socket = spec->prefer_extra_socket;
-            
+            param.batch_depth = spec->batch_depth;
+            param.use_io_uring = spec->use_io_uring;
+            param.use_rio = spec->use_rio;
+            param.use_select = spec->use_select;
+            param.txtime_horizon = spec->txtime_horizon;
+            param.zerocopy_pool_size = spec->zerocopy_pool_size;
+            param.use_receive_timestamps = spec->use_receive_timestamps;
+            param.metrics_port = spec->metrics_port;
+            param.busy_poll_budget = spec->busy_poll_budget;
+            param.pin_to_cpu = spec->pin_to_cpu;
+            param.numa_local = spec->numa_local;
+            if (spec->pin_to_cpu) {
+                param.cpu_index = sockloop_test_first_cpu();
+            }
+#ifndef _WINDOWS
+            if (spec->use_io_provider) {
+                param.io_provider = &picoquic_socket_io_provider;
+            }
+#endif
 
             loop_cb.force_migration = spec->force_migration;
             loop_cb.param = &param;
+            loop_cb.use_command_queue = spec->use_command_queue;
 
             if (spec->use_background_thread) {
                 if (spec->thread_name != NULL) {
@@ -555,11 +813,20 @@ int sockloop_test_one(sockloop_test_spec_t *spec)
                         DBG_PRINTF("%s", "Cannot start the network thread in 2000ms");
                         ret = -1;
                     }
+                    else if (spec->use_command_queue) {
+                        /* Post a burst of commands. Only posts to an empty queue wake up the thread. */
+                        for (int i = 0; ret == 0 && i < 4; i++) {
+                            if (picoquic_post_network_callback(thread_ctx, sockloop_test_command, &loop_cb) != 0) {
+                                DBG_PRINTF("%s", "Cannot post command to the network thread");
+                                ret = -1;
+                            }
+                        }
+                    }
                     else if (picoquic_wake_up_network_thread(thread_ctx) != 0) {
                         DBG_PRINTF("%s", "Cannot wakeup the network thread");
                         ret = -1;
                     }
-                    else {
+                    if (ret == 0) {
                         for (int i = 0; i < 50; i++) {
                             if (sockloop_test_received_finished(test_ctx)) {
                                 DBG_PRINTF("Receive finished after %dms", 100 * i);
@@ -587,9 +854,26 @@ int sockloop_test_one(sockloop_test_spec_t *spec)
         else if (spec->force_migration != 0 && loop_cb.address_updated == 0) {
             ret = -1;
         }
+        else if (spec->use_command_queue && loop_cb.nb_commands != 4) {
+            DBG_PRINTF("Executed %d commands instead of 4", loop_cb.nb_commands);
+            ret = -1;
+        }
+        else if (spec->metrics_port != 0 && sockloop_test_verify_metrics(&loop_cb, test_ctx->qserver) != 0) {
+            ret = -1;
+        }
+        else if (loop_cb.affinity_verified < 0) {
+            ret = -1;
+        }
+        else if (spec->busy_poll_budget != 0 && loop_cb.nb_spin_reported == 0) {
+            DBG_PRINTF("%s", "No busy poll spin was reported");
+            ret = -1;
+        }
         else if (spec->force_migration != 0 && sockloop_test_verify_migration(&loop_cb, test_ctx->cnx_client) != 0) {
             ret = -1;
         }
+        else if (spec->timer_slack != 0 && sockloop_test_verify_wakeups(&loop_cb, test_ctx->qserver) != 0) {
+            ret = -1;
+        }
         else {
             ret = tls_api_one_scenario_verify(test_ctx);
         }
@@ -730,4 +1014,561 @@ int sockloop_thread_name_test()
     spec.thread_name = "picoquic loop";
 
     return(sockloop_test_one(&spec));
-}
\ No newline at end of file
+}
+
+int sockloop_batch_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 9);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.batch_depth = 16;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_uring_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 10);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.use_io_uring = 1;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_select_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 11);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.use_select = 1;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_txtime_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 12);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.txtime_horizon = 1000;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_zerocopy_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 13);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.zerocopy_pool_size = 16;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_command_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 14);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.use_background_thread = 1;
+    spec.use_command_queue = 1;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_rio_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 15);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.use_rio = 1;
+
+    return(sockloop_test_one(&spec));
+}
+
+/* Run the loop through the socket I/O provider, in a background thread
+ * so that the commands exercise the wake up of the provider loop. */
+int sockloop_provider_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 17);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.use_background_thread = 1;
+    spec.use_command_queue = 1;
+    spec.use_io_provider = 1;
+
+    return(sockloop_test_one(&spec));
+}
+
+/* Spin for up to 1ms before blocking, and check that the spins are reported */
+int sockloop_busy_poll_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 18);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.busy_poll_budget = 1000;
+
+    return(sockloop_test_one(&spec));
+}
+
+/* Pin the network thread to the first CPU that the test process may use,
+ * with a NUMA local memory policy, and check the affinity from the thread. */
+int sockloop_affinity_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 19);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.use_background_thread = 1;
+    spec.pin_to_cpu = 1;
+    spec.numa_local = 1;
+
+    return(sockloop_test_one(&spec));
+}
+
+/* Run the loop with a timer slack, and check the wake ups that it records */
+int sockloop_timer_slack_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 20);
+    spec.socket_buffer_size = 0xffff;
+    spec.scenario = sockloop_test_scenario_1M;
+    spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+    spec.timer_slack = 2000;
+
+    return(sockloop_test_one(&spec));
+}
+
+/* Verify that the SO_REUSEPORT steering program delivers each packet to
+ * the socket whose rank in the port group matches the shard index
+ * encoded in the second byte of the destination CID. */
+int sockloop_reuseport_test()
+{
+    int ret = 0;
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    picoquic_socket_ctx_t s_ctx[2][PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    SOCKET_TYPE fds[2];
+    SOCKET_TYPE send_fd = INVALID_SOCKET;
+    struct sockaddr_in server_addr;
+    uint16_t port = 3458;
+    int nb_opened = 0;
+    /* short header to shard 1, short header to shard 0, long header to shard 1 */
+    uint8_t packets[3][16] = {
+        { 0x40, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0, 0, 0, 0, 0, 0, 0 },
+        { 0x40, 0x11, 0x00, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0, 0, 0, 0, 0, 0, 0 },
+        { 0xc0, 0x00, 0x00, 0x00, 0x01, 0x08, 0x22, 0x01, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0, 0 }
+    };
+    int expected_rank[3] = { 1, 0, 1 };
+
+    memset(s_ctx, 0, sizeof(s_ctx));
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        s_ctx[i][0].reuse_port = 1;
+        s_ctx[i][0].reuseport_steering_shards = (i == 0) ? 2 : 0;
+        if (picoquic_packet_loop_open_sockets(port, AF_INET, 0, 0, 1, s_ctx[i]) != 1) {
+            DBG_PRINTF("Cannot open reuseport socket %d", i);
+            ret = -1;
+        }
+        else {
+            fds[i] = s_ctx[i][0].fd;
+            nb_opened++;
+        }
+    }
+
+    if (ret == 0 && (send_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+        ret = -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        struct sockaddr_storage addr_from;
+        struct sockaddr_storage addr_dest;
+        int dest_if = 0;
+        unsigned char ecn = 0;
+        uint8_t buffer[256];
+        int socket_rank = -1;
+        uint64_t current_time = 0;
+        int bytes_recv;
+
+        if (sendto(send_fd, (const char*)packets[i], sizeof(packets[i]), 0,
+            (struct sockaddr*)&server_addr, sizeof(server_addr)) != (ssize_t)sizeof(packets[i])) {
+            DBG_PRINTF("Cannot send packet %d", i);
+            ret = -1;
+        }
+        else if ((bytes_recv = picoquic_select_ex(fds, 2, &addr_from, &addr_dest, &dest_if, &ecn,
+            buffer, sizeof(buffer), 1000000, &socket_rank, &current_time)) != (int)sizeof(packets[i])) {
+            DBG_PRINTF("Packet %d not received, bytes_recv=%d", i, bytes_recv);
+            ret = -1;
+        }
+        else if (socket_rank != expected_rank[i]) {
+            DBG_PRINTF("Packet %d received on socket %d instead of %d", i, socket_rank, expected_rank[i]);
+            ret = -1;
+        }
+    }
+
+    if (send_fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(send_fd);
+    }
+    for (int i = 0; i < nb_opened; i++) {
+        picoquic_packet_loop_close_socket(&s_ctx[i][0]);
+    }
+#endif
+    return ret;
+}
+
+/* Verify that the dispatcher passes each datagram to the ring of the worker
+ * encoded in DCID[1], and that the workers can send on the shared socket. */
+int sockloop_dispatch_test()
+{
+    int ret = 0;
+#ifndef _WINDOWS
+    picoquic_packet_loop_param_t param;
+    picoquic_dispatcher_t* dispatcher = NULL;
+    picoquic_dispatch_worker_param_t worker_param[2];
+    void* io_ctx[2] = { NULL, NULL };
+    SOCKET_TYPE send_fd = INVALID_SOCKET;
+    struct sockaddr_in server_addr;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    /* short header to worker 1, short header to worker 0, long header to worker 1, long header with short CID to worker 0 */
+    uint8_t packets[4][16] = {
+        { 0x40, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0, 0, 0, 0, 0, 0, 0 },
+        { 0x40, 0x11, 0x00, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0, 0, 0, 0, 0, 0, 0 },
+        { 0xc0, 0x00, 0x00, 0x00, 0x01, 0x08, 0x22, 0x01, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0, 0 },
+        { 0xc0, 0x00, 0x00, 0x00, 0x01, 0x01, 0x23, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0, 0 }
+    };
+    int expected_worker[4] = { 1, 0, 1, 0 };
+    uint64_t nb_expected[2] = { 2, 2 };
+
+    memset(&param, 0, sizeof(param));
+    param.local_af = AF_INET;
+    param.do_not_use_gso = 1;
+
+    for (int i = 0; ret == 0 && i < 4; i++) {
+        if (picoquic_dispatch_worker_index(packets[i], sizeof(packets[i]), 2) != expected_worker[i]) {
+            DBG_PRINTF("Packet %d mapped to the wrong worker", i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (dispatcher = picoquic_start_dispatcher(&param, 2, &ret)) == NULL) {
+        DBG_PRINTF("Cannot start the dispatcher, ret=%d", ret);
+        ret = -1;
+    }
+    for (int w = 0; ret == 0 && w < 2; w++) {
+        struct sockaddr_storage local_addr;
+        if (picoquic_dispatcher_worker_param(dispatcher, w, &worker_param[w]) != 0 ||
+            picoquic_dispatch_io_provider.open(&param, &worker_param[w], -1, &io_ctx[w], &local_addr) != 0) {
+            DBG_PRINTF("Cannot open the provider of worker %d", w);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        void* second_ctx = NULL;
+        struct sockaddr_storage local_addr;
+        if (picoquic_dispatch_io_provider.open(&param, &worker_param[0], -1, &second_ctx, &local_addr) == 0) {
+            DBG_PRINTF("%s", "Ring opened twice");
+            picoquic_dispatch_io_provider.close(second_ctx);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (send_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+        ret = -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = (dispatcher == NULL) ? 0 : htons(picoquic_dispatcher_port(dispatcher));
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; ret == 0 && i < 4; i++) {
+        picoquic_packet_io_t rx_packet;
+        int w = expected_worker[i];
+        int is_wake_up = 0;
+        int nb_received = 0;
+
+        if (sendto(send_fd, (const char*)packets[i], sizeof(packets[i]), 0,
+            (struct sockaddr*)&server_addr, sizeof(server_addr)) != (ssize_t)sizeof(packets[i])) {
+            DBG_PRINTF("Cannot send packet %d", i);
+            ret = -1;
+        }
+        for (int t = 0; ret == 0 && nb_received == 0 && t < 10; t++) {
+            if (picoquic_dispatch_io_provider.wait(io_ctx[w], 100000, &is_wake_up) < 0) {
+                ret = -1;
+            }
+            else {
+                nb_received = picoquic_dispatch_io_provider.rx_burst(io_ctx[w], &rx_packet, 1);
+            }
+        }
+        if (ret == 0 && (nb_received != 1 || rx_packet.length != sizeof(packets[i]) ||
+            memcmp(rx_packet.bytes, packets[i], sizeof(packets[i])) != 0)) {
+            DBG_PRINTF("Packet %d not received by worker %d", i, w);
+            ret = -1;
+        }
+        if (ret == 0 && picoquic_dispatch_io_provider.rx_burst(io_ctx[1 - w], &rx_packet, 1) != 0) {
+            DBG_PRINTF("Packet %d received by worker %d", i, 1 - w);
+            ret = -1;
+        }
+        if (ret == 0) {
+            picoquic_dispatch_io_provider.release_buffer(io_ctx[w], &rx_packet);
+        }
+    }
+
+    for (int w = 0; ret == 0 && w < 2; w++) {
+        uint64_t nb_dispatched;
+        uint64_t nb_dropped;
+
+        picoquic_get_dispatcher_stats(dispatcher, w, &nb_dispatched, &nb_dropped);
+        if (nb_dispatched != nb_expected[w] || nb_dropped != 0) {
+            DBG_PRINTF("Worker %d, dispatched %" PRIu64 ", dropped %" PRIu64, w, nb_dispatched, nb_dropped);
+            ret = -1;
+        }
+    }
+
+    /* Send a response from worker 1 through the shared socket */
+    if (ret == 0 && getsockname(send_fd, (struct sockaddr*)&client_addr, &client_addr_len) != 0) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        picoquic_packet_io_t tx_packet;
+        int sock_err = 0;
+        uint8_t buffer[256];
+
+        client_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (picoquic_dispatch_io_provider.get_buffer(io_ctx[1], &tx_packet) != 0) {
+            ret = -1;
+        }
+        else {
+            memcpy(tx_packet.bytes, packets[0], sizeof(packets[0]));
+            tx_packet.length = sizeof(packets[0]);
+            tx_packet.send_msg_size = 0;
+            tx_packet.if_index = 0;
+            picoquic_store_addr(&tx_packet.addr_peer, (struct sockaddr*)&client_addr);
+            memset(&tx_packet.addr_local, 0, sizeof(tx_packet.addr_local));
+            if (picoquic_dispatch_io_provider.tx_burst(io_ctx[1], &tx_packet, 1, &sock_err) != 1) {
+                DBG_PRINTF("Cannot send from worker 1, err=%d", sock_err);
+                ret = -1;
+            }
+            else if (recv(send_fd, (char*)buffer, sizeof(buffer), 0) != (ssize_t)sizeof(packets[0])) {
+                DBG_PRINTF("%s", "Response not received");
+                ret = -1;
+            }
+        }
+    }
+
+    if (send_fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(send_fd);
+    }
+    for (int w = 0; w < 2; w++) {
+        if (io_ctx[w] != NULL) {
+            picoquic_dispatch_io_provider.close(io_ctx[w]);
+        }
+    }
+    picoquic_delete_dispatcher(dispatcher);
+#endif
+    return ret;
+}
+
+/* Verify that datagrams sent as a GSO train on the loopback interface
+ * are received coalesced on a socket opened with UDP GRO, and that the
+ * segment size is reported by picoquic_recvmsg_ex. Sockets opened
+ * without requesting GRO must not receive coalesced datagrams. */
+int sockloop_gro_test()
+{
+    int ret = 0;
+#if defined(UDP_GRO) && defined(UDP_SEGMENT)
+    picoquic_socket_ctx_t s_ctx[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    struct sockaddr_storage server_addr;
+    SOCKET_TYPE send_fd = INVALID_SOCKET;
+    uint8_t send_buffer[4 * 1200 + 500];
+    uint8_t recv_buffer[0x10000];
+    size_t segment_size = 1200;
+    int nb_opened = 0;
+
+    memset(s_ctx, 0, sizeof(s_ctx));
+    for (size_t i = 0; i < sizeof(send_buffer); i++) {
+        send_buffer[i] = (uint8_t)i;
+    }
+    /* GRO is only set if requested */
+    if (picoquic_packet_loop_open_sockets(0, AF_INET, 0, 0, 0, s_ctx) != 1) {
+        ret = -1;
+    }
+    else {
+        if (s_ctx[0].supports_udp_recv_coalesced) {
+            DBG_PRINTF("%s", "UDP GRO set without being requested.");
+            ret = -1;
+        }
+        picoquic_packet_loop_close_socket(&s_ctx[0]);
+    }
+    memset(s_ctx, 0, sizeof(s_ctx));
+    s_ctx[0].use_gro = 1;
+    if (ret != 0 || (nb_opened = picoquic_packet_loop_open_sockets(0, AF_INET, 0, 0, 0, s_ctx)) != 1) {
+        ret = -1;
+    }
+    else if (!s_ctx[0].supports_udp_recv_coalesced) {
+        /* Kernel does not support UDP GRO, nothing to test */
+        DBG_PRINTF("%s", "UDP GRO not supported, skipping test.");
+    }
+    else if ((send_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET ||
+        picoquic_store_loopback_addr(&server_addr, AF_INET, s_ctx[0].port) != 0) {
+        ret = -1;
+    }
+    else {
+        int sock_err = 0;
+        int sent = picoquic_sendmsg(send_fd, (struct sockaddr*)&server_addr, NULL, 0,
+            (const char*)send_buffer, (int)sizeof(send_buffer), (int)segment_size, &sock_err);
+
+        if (sent != (int)sizeof(send_buffer)) {
+            /* GSO not supported by the send path, nothing to test */
+            DBG_PRINTF("GSO send returns %d, err=%d, skipping test.", sent, sock_err);
+        }
+        else {
+            size_t received = 0;
+
+            for (int nb_reads = 0; ret == 0 && received < sizeof(send_buffer) && nb_reads < 5; nb_reads++) {
+                struct sockaddr_storage addr_from;
+                struct sockaddr_storage addr_dest;
+                int dest_if = 0;
+                unsigned char ecn = 0;
+                size_t udp_coalesced_size = 0;
+                int bytes_recv = picoquic_recvmsg_ex(s_ctx[0].fd, &addr_from, &addr_dest, &dest_if, &ecn,
+                    recv_buffer, (int)sizeof(recv_buffer), 0, &udp_coalesced_size, NULL);
+
+                if (bytes_recv <= 0 || (size_t)bytes_recv > sizeof(send_buffer) - received ||
+                    memcmp(recv_buffer, send_buffer + received, bytes_recv) != 0) {
+                    DBG_PRINTF("Unexpected GRO read, %d bytes at offset %zu", bytes_recv, received);
+                    ret = -1;
+                }
+                else if ((size_t)bytes_recv > segment_size && udp_coalesced_size != segment_size) {
+                    DBG_PRINTF("Coalesced %d bytes, segment size %zu", bytes_recv, udp_coalesced_size);
+                    ret = -1;
+                }
+                else {
+                    received += (size_t)bytes_recv;
+                }
+            }
+            if (ret == 0 && received != sizeof(send_buffer)) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (send_fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(send_fd);
+    }
+    for (int i = 0; i < nb_opened; i++) {
+        picoquic_packet_loop_close_socket(&s_ctx[i]);
+    }
+#endif
+    return ret;
+}
+
+/* Verify that a socket opened with receive timestamps reports the arrival
+ * time of a datagram, between the send and receive calls, then run the
+ * loop with the timestamps passed to the stack. */
+/* Serve the context metrics on a local OpenMetrics endpoint, scrape it
+ * while the connection runs, and check the counters at the end. */
+int sockloop_metrics_test()
+{
+    sockloop_test_spec_t spec;
+    sockloop_test_set_spec(&spec, 2);
+    spec.metrics_port = 3457;
+
+    return(sockloop_test_one(&spec));
+}
+
+int sockloop_timestamp_test()
+{
+    int ret = 0;
+#ifndef _WINDOWS
+    picoquic_socket_ctx_t s_ctx[PICOQUIC_PACKET_LOOP_SOCKETS_MAX];
+    struct sockaddr_storage server_addr;
+    SOCKET_TYPE send_fd = INVALID_SOCKET;
+    uint8_t buffer[256];
+    int nb_opened = 0;
+
+    memset(s_ctx, 0, sizeof(s_ctx));
+    memset(buffer, 0x5a, sizeof(buffer));
+    s_ctx[0].use_rx_timestamps = 1;
+    if ((nb_opened = picoquic_packet_loop_open_sockets(0, AF_INET, 0, 0, 1, s_ctx)) != 1) {
+        ret = -1;
+    }
+    else if (!s_ctx[0].use_rx_timestamps) {
+        /* Kernel does not support receive timestamps, nothing to verify */
+        DBG_PRINTF("%s", "Receive timestamps not supported, skipping check.");
+    }
+    else if ((send_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET ||
+        picoquic_store_loopback_addr(&server_addr, AF_INET, s_ctx[0].port) != 0) {
+        ret = -1;
+    }
+    else {
+        int sock_err = 0;
+        uint64_t send_time = picoquic_current_time();
+        struct sockaddr_storage addr_from;
+        struct sockaddr_storage addr_dest;
+        int dest_if = 0;
+        unsigned char ecn = 0;
+        uint64_t receive_time = 0;
+        uint64_t read_time;
+        int bytes_recv;
+
+        if (picoquic_sendmsg(send_fd, (struct sockaddr*)&server_addr, NULL, 0,
+            (const char*)buffer, (int)sizeof(buffer), 0, &sock_err) != (int)sizeof(buffer)) {
+            ret = -1;
+        }
+        else {
+            bytes_recv = picoquic_recvmsg_ex(s_ctx[0].fd, &addr_from, &addr_dest, &dest_if, &ecn,
+                buffer, (int)sizeof(buffer), 0, NULL, &receive_time);
+            read_time = picoquic_current_time();
+            if (bytes_recv != (int)sizeof(buffer) || receive_time < send_time || receive_time > read_time) {
+                DBG_PRINTF("Received %d bytes, timestamp %" PRIu64 " not in [%" PRIu64 ", %" PRIu64 "]",
+                    bytes_recv, receive_time, send_time, read_time);
+                ret = -1;
+            }
+        }
+    }
+
+    if (send_fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(send_fd);
+    }
+    for (int i = 0; i < nb_opened; i++) {
+        picoquic_packet_loop_close_socket(&s_ctx[i]);
+    }
+#endif
+
+    if (ret == 0) {
+        sockloop_test_spec_t spec;
+        sockloop_test_set_spec(&spec, 16);
+        spec.socket_buffer_size = 0xffff;
+        spec.scenario = sockloop_test_scenario_1M;
+        spec.scenario_size = sizeof(sockloop_test_scenario_1M);
+        spec.use_receive_timestamps = 1;
+
+        ret = sockloop_test_one(&spec);
+    }
+    return ret;
+}
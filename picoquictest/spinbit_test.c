@@ -30,6 +30,7 @@
 #include "picoquic_binlog.h"
 #include "picoquic_logger.h"
 #include "qlog.h"
+#include "picoquic_spin_observer.h"
 
 
 /*
@@ -218,3 +219,165 @@ int spinbit_bad_test()
 }
 
 
+
+/*
+ * Spin bit observer test. Feed the observer with the short header packets of
+ * a flow whose spin bit flips every 40 ms, seen from the middle of the path,
+ * and verify the RTT estimates, the rejection of a reordered packet, the flow
+ * creation rules and the eviction of flows when the table is full.
+ */
+
+#define SPINOBS_TEST_RTT 40000
+#define SPINOBS_TEST_INTERVAL 2500
+
+static void spinobs_test_flow_end(picoquic_spinobs_t* obs, const picoquic_spinobs_flow_t* flow, void* flow_end_ctx)
+{
+    (void)obs;
+    (void)flow;
+    (*(int*)flow_end_ctx)++;
+}
+
+static size_t spinobs_test_packet(uint8_t* bytes, int is_long, int spin)
+{
+    size_t length = 0;
+
+    memset(bytes, 0, 64);
+    if (is_long) {
+        /* Version 1 Initial, empty token, 32 bytes of payload */
+        uint8_t header[] = { 0xc3, 0, 0, 0, 1, 8, 1, 2, 3, 4, 5, 6, 7, 8, 0, 0, 32 };
+        memcpy(bytes, header, sizeof(header));
+        length = sizeof(header) + 32;
+    }
+    else {
+        bytes[0] = (uint8_t)(0x40 | (spin << 5));
+        length = 48;
+    }
+
+    return length;
+}
+
+static int spinobs_test_send(picoquic_spinobs_t* obs, uint8_t client_id, int to_server, int is_long, int spin,
+    uint64_t current_time)
+{
+    uint8_t client_addr[4] = { 10, 0, 0, 0 };
+    uint8_t server_addr[4] = { 10, 0, 1, 1 };
+    uint8_t bytes[64];
+    size_t length = spinobs_test_packet(bytes, is_long, spin);
+
+    client_addr[3] = client_id;
+    return (to_server) ?
+        picoquic_spinobs_process_udp(obs, 4, client_addr, 4433, server_addr, 443, bytes, length, current_time) :
+        picoquic_spinobs_process_udp(obs, 4, server_addr, 443, client_addr, 4433, bytes, length, current_time);
+}
+
+static int spinobs_test_buckets()
+{
+    int ret = 0;
+    uint64_t rtt = 1;
+
+    while (ret == 0 && rtt < 4 * PICOQUIC_SPINOBS_RTT_MAX) {
+        int bucket_index = picoquic_spinobs_bucket_index(rtt);
+        if (rtt < picoquic_spinobs_bucket_floor(bucket_index) ||
+            (bucket_index < PICOQUIC_SPINOBS_NB_BUCKETS - 1 && rtt >= picoquic_spinobs_bucket_floor(bucket_index + 1))) {
+            DBG_PRINTF("RTT %" PRIu64 " not in bucket %d", rtt, bucket_index);
+            ret = -1;
+        }
+        rtt += 1 + rtt / 7;
+    }
+
+    return ret;
+}
+
+int spinbit_observer_test()
+{
+    picoquic_spinobs_t obs;
+    const picoquic_spinobs_flow_t* flow = NULL;
+    uint64_t current_time = 1000000;
+    size_t index = 0;
+    int nb_ended = 0;
+    int ret = spinobs_test_buckets();
+
+    if (ret == 0 && picoquic_spinobs_init(&obs, 8, 0x5eed) != 0) {
+        ret = -1;
+    }
+    else if (ret == 0) {
+        picoquic_spinobs_set_flow_end_callback(&obs, spinobs_test_flow_end, &nb_ended);
+
+        /* Short header packets do not create flows, a long header does. */
+        if (spinobs_test_send(&obs, 1, 1, 0, 0, current_time) != 0 ||
+            picoquic_spinobs_next_flow(&obs, &index) != NULL) {
+            DBG_PRINTF("%s", "Flow created by a short header");
+            ret = -1;
+        }
+        else {
+            index = 0;
+            if (spinobs_test_send(&obs, 1, 1, 1, 0, current_time) != 0 ||
+                (flow = picoquic_spinobs_next_flow(&obs, &index)) == NULL) {
+                DBG_PRINTF("%s", "Flow creation failed");
+                ret = -1;
+            }
+        }
+
+        /* One second of traffic. The server side spin lags by a quarter RTT.
+         * One client packet from the previous period arrives just after an edge. */
+        for (int i = 0; ret == 0 && i < 1000000 / SPINOBS_TEST_INTERVAL; i++) {
+            uint64_t t = (uint64_t)i * SPINOBS_TEST_INTERVAL;
+            int client_spin = (int)((t / SPINOBS_TEST_RTT) & 1);
+            int server_spin = (int)(((t + 3 * SPINOBS_TEST_RTT / 4) / SPINOBS_TEST_RTT) & 1);
+
+            if (i == 193) {
+                client_spin ^= 1;
+            }
+            if (spinobs_test_send(&obs, 1, 1, 0, client_spin, current_time + t) != 0 ||
+                spinobs_test_send(&obs, 1, 0, 0, server_spin, current_time + t) != 0) {
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && (flow->nb_samples < 40 || flow->nb_edges_rejected != 1 ||
+            flow->rtt_min != SPINOBS_TEST_RTT || flow->rtt_max != SPINOBS_TEST_RTT ||
+            picoquic_spinobs_percentile(flow, 50) != SPINOBS_TEST_RTT ||
+            picoquic_spinobs_percentile(flow, 99) != SPINOBS_TEST_RTT)) {
+            DBG_PRINTF("Samples: %" PRIu64 ", rejected: %" PRIu64 ", min: %" PRIu64 ", max: %" PRIu64,
+                flow->nb_samples, flow->nb_edges_rejected, flow->rtt_min, flow->rtt_max);
+            ret = -1;
+        }
+
+        /* The 8 slot table cannot hold 20 flows: the idle ones are evicted. */
+        for (uint8_t client_id = 2; ret == 0 && client_id < 22; client_id++) {
+            ret = spinobs_test_send(&obs, client_id, 1, 1, 0, current_time + 2000000 + client_id);
+        }
+        if (ret == 0 && (obs.nb_flows_created != 21 || obs.nb_flows_evicted == 0 ||
+            nb_ended != (int)obs.nb_flows_evicted)) {
+            DBG_PRINTF("Created %" PRIu64 ", evicted %" PRIu64 ", ended %d",
+                obs.nb_flows_created, obs.nb_flows_evicted, nb_ended);
+            ret = -1;
+        }
+
+        /* Idle flows expire, and flushing exports all the others. */
+        if (ret == 0) {
+            picoquic_spinobs_expire(&obs, current_time + 2000000 + 18 + PICOQUIC_SPINOBS_FLOW_IDLE);
+            picoquic_spinobs_flush(&obs);
+            index = 0;
+            if (obs.nb_flows_expired == 0 || nb_ended != 21 || picoquic_spinobs_next_flow(&obs, &index) != NULL) {
+                DBG_PRINTF("Expired %" PRIu64 ", ended %d", obs.nb_flows_expired, nb_ended);
+                ret = -1;
+            }
+        }
+
+        /* With create_on_short_header, short header packets start flows. */
+        if (ret == 0) {
+            obs.create_on_short_header = 1;
+            index = 0;
+            if (spinobs_test_send(&obs, 1, 1, 0, 0, current_time + 3 * PICOQUIC_SPINOBS_FLOW_IDLE) != 0 ||
+                picoquic_spinobs_next_flow(&obs, &index) == NULL) {
+                DBG_PRINTF("%s", "Flow not created on short header");
+                ret = -1;
+            }
+        }
+
+        picoquic_spinobs_clear(&obs);
+    }
+
+    return ret;
+}
@@ -25,8 +25,12 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "picoquic.h"
 #include "picoquic_utils.h"
 #include "picosplay.h"
+#include "picorbtree.h"
+#include "picowheel.h"
 
 typedef struct st_int_node_t {
     int v;
@@ -251,3 +255,566 @@ int splay_test() {
 
     return ret;
 }
+
+/* Timer wheel test.
+ * Perform a random series of insertions, removals and time advances, and
+ * verify after each step that the first node in the wheel is the one with
+ * the earliest wake time, as found by an exhaustive search.
+ */
+#define TIMER_WHEEL_TEST_NODES 128
+#define TIMER_WHEEL_TEST_STEPS 20000
+
+static uint64_t timer_wheel_test_delay(uint64_t* random_ctx)
+{
+    static const uint64_t delay_max[4] = { 256, 100000, 30000000, 4000000000ull };
+    uint64_t scale = picoquic_test_uniform_random(random_ctx, 4);
+
+    return picoquic_test_uniform_random(random_ctx, delay_max[scale]);
+}
+
+int timer_wheel_test()
+{
+    int ret = 0;
+    uint64_t random_ctx = 0x123456789abcdefull;
+    uint64_t current_time = 0x1234567;
+    picowheel_node_t nodes[TIMER_WHEEL_TEST_NODES];
+    picowheel_t* wheel = picowheel_new(current_time);
+
+    memset(nodes, 0, sizeof(nodes));
+
+    if (wheel == NULL) {
+        DBG_PRINTF("%s", "Cannot create wheel.\n");
+        ret = -1;
+    }
+
+    for (int step = 0; ret == 0 && step < TIMER_WHEEL_TEST_STEPS; step++) {
+        picowheel_node_t* first;
+        picowheel_node_t* expected = NULL;
+        int nb_inserted = 0;
+        int action = (int)picoquic_test_uniform_random(&random_ctx, 8);
+        int rank = (int)picoquic_test_uniform_random(&random_ctx, TIMER_WHEEL_TEST_NODES);
+
+        if (action < 4) {
+            /* Insert or reinsert a node. Some wake times are in the past. */
+            uint64_t wake_time = current_time + timer_wheel_test_delay(&random_ctx);
+            if (action == 0 && rank == 0) {
+                wake_time = current_time - 1000;
+            }
+            picowheel_insert(wheel, &nodes[rank], wake_time);
+        }
+        else if (action < 6) {
+            picowheel_remove(wheel, &nodes[rank]);
+        }
+        else if (action == 6) {
+            current_time += picoquic_test_uniform_random(&random_ctx, (rank & 1) ? 1000 : 1000000);
+            picowheel_advance(wheel, current_time);
+        }
+        else {
+            /* Process the nodes that are due, as the server loop would */
+            while ((first = picowheel_first(wheel)) != NULL && first->wake_time <= current_time) {
+                picowheel_insert(wheel, first, current_time + 1 + timer_wheel_test_delay(&random_ctx));
+            }
+        }
+
+        for (int i = 0; i < TIMER_WHEEL_TEST_NODES; i++) {
+            if (nodes[i].is_inserted) {
+                nb_inserted++;
+                if (expected == NULL || nodes[i].wake_time < expected->wake_time) {
+                    expected = &nodes[i];
+                }
+            }
+        }
+        first = picowheel_first(wheel);
+
+        if (wheel->size != nb_inserted) {
+            DBG_PRINTF("Step %d, expected %d nodes, got %d\n", step, nb_inserted, wheel->size);
+            ret = -1;
+        }
+        else if ((first == NULL) != (expected == NULL) ||
+            (first != NULL && first->wake_time != expected->wake_time)) {
+            DBG_PRINTF("Step %d, expected first at %" PRIu64 ", got %" PRIu64 "\n", step,
+                (expected == NULL) ? 0 : expected->wake_time, (first == NULL) ? 0 : first->wake_time);
+            ret = -1;
+        }
+    }
+
+    if (wheel != NULL) {
+        for (int i = 0; i < TIMER_WHEEL_TEST_NODES; i++) {
+            picowheel_remove(wheel, &nodes[i]);
+        }
+        if (ret == 0 && (wheel->size != 0 || picowheel_first(wheel) != NULL)) {
+            DBG_PRINTF("%s", "Wheel not empty after removing all nodes.\n");
+            ret = -1;
+        }
+        picowheel_delete(wheel);
+    }
+
+    return ret;
+}
+
+/* Red-black tree test.
+ * Perform a random series of insertions and deletions, with duplicate keys,
+ * and verify after each step the ordering, the red and black properties,
+ * the size, and the results of picorb_find and picorb_find_previous.
+ */
+#define RB_TREE_TEST_RANGE 256
+#define RB_TREE_TEST_STEPS 20000
+
+typedef struct st_rb_int_node_t {
+    int v;
+    picorb_node_t node;
+} rb_int_node_t;
+
+static picorb_node_t* create_rb_int_node(void* value)
+{
+    return &((rb_int_node_t*)value)->node;
+}
+
+static void* rb_int_node_value(picorb_node_t* node)
+{
+    return (void*)((char*)node - offsetof(struct st_rb_int_node_t, node));
+}
+
+static void delete_rb_int_node(void* tree, picorb_node_t* node)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(tree);
+#endif
+    free(rb_int_node_value(node));
+}
+
+static int64_t compare_rb_int(void* l, void* r)
+{
+    return (int64_t)((rb_int_node_t*)l)->v - ((rb_int_node_t*)r)->v;
+}
+
+/* Returns the black height of the subtree, or -1 if it is not valid. */
+static int check_rb_node(picorb_node_t* x, int* count)
+{
+    int black_height = 1;
+
+    if (x != NULL) {
+        int left_height = check_rb_node(x->left, count);
+        int right_height = check_rb_node(x->right, count);
+
+        (*count)++;
+        if (left_height < 0 || right_height < 0 || left_height != right_height ||
+            (x->left != NULL && (x->left->parent != x || compare_rb_int(rb_int_node_value(x->left), rb_int_node_value(x)) > 0)) ||
+            (x->right != NULL && (x->right->parent != x || compare_rb_int(rb_int_node_value(x->right), rb_int_node_value(x)) < 0)) ||
+            (x->is_red && ((x->left != NULL && x->left->is_red) || (x->right != NULL && x->right->is_red)))) {
+            black_height = -1;
+        }
+        else {
+            black_height = left_height + (x->is_red ? 0 : 1);
+        }
+    }
+
+    return black_height;
+}
+
+int rbtree_test()
+{
+    int ret = 0;
+    uint64_t random_ctx = 0xfedcba9876543210ull;
+    int nb_copies[RB_TREE_TEST_RANGE];
+    int nb_nodes = 0;
+    picorb_tree_t* tree = picorb_new_tree(compare_rb_int, create_rb_int_node, delete_rb_int_node, rb_int_node_value);
+
+    memset(nb_copies, 0, sizeof(nb_copies));
+
+    if (tree == NULL) {
+        DBG_PRINTF("%s", "Cannot create tree.\n");
+        ret = -1;
+    }
+
+    for (int step = 0; ret == 0 && step < RB_TREE_TEST_STEPS; step++) {
+        /* Grow the tree in the first half of the test, shrink it in the second */
+        int is_insert = (int)picoquic_test_uniform_random(&random_ctx, 4) < ((step < RB_TREE_TEST_STEPS / 2) ? 3 : 1);
+        rb_int_node_t key;
+        picorb_node_t* found;
+        int count = 0;
+
+        key.v = (int)picoquic_test_uniform_random(&random_ctx, RB_TREE_TEST_RANGE);
+
+        if (is_insert) {
+            rb_int_node_t* i_n = (rb_int_node_t*)malloc(sizeof(rb_int_node_t));
+            if (i_n == NULL) {
+                ret = -1;
+                break;
+            }
+            i_n->v = key.v;
+            (void)picorb_insert(tree, i_n);
+            nb_copies[key.v]++;
+            nb_nodes++;
+        }
+        else if (nb_copies[key.v] > 0) {
+            if ((int)picoquic_test_uniform_random(&random_ctx, 2) == 0) {
+                picorb_delete(tree, &key);
+            }
+            else {
+                picorb_delete_hint(tree, picorb_find(tree, &key));
+            }
+            nb_copies[key.v]--;
+            nb_nodes--;
+        }
+
+        found = picorb_find(tree, &key);
+
+        if (check_rb_node(tree->root, &count) < 0 || (tree->root != NULL && tree->root->is_red)) {
+            DBG_PRINTF("Step %d, invalid tree\n", step);
+            ret = -1;
+        }
+        else if (count != nb_nodes || tree->size != nb_nodes) {
+            DBG_PRINTF("Step %d, expected %d nodes, got %d, size %d\n", step, nb_nodes, count, tree->size);
+            ret = -1;
+        }
+        else if ((found != NULL) != (nb_copies[key.v] > 0) ||
+            (found != NULL && (((rb_int_node_t*)rb_int_node_value(found))->v != key.v ||
+            (picorb_previous(found) != NULL && ((rb_int_node_t*)rb_int_node_value(picorb_previous(found)))->v == key.v)))) {
+            DBG_PRINTF("Step %d, find %d fails\n", step, key.v);
+            ret = -1;
+        }
+        else {
+            picorb_node_t* previous = picorb_find_previous(tree, &key);
+            int expected = key.v;
+
+            while (expected >= 0 && nb_copies[expected] == 0) {
+                expected--;
+            }
+            if ((previous == NULL) != (expected < 0) ||
+                (previous != NULL && (((rb_int_node_t*)rb_int_node_value(previous))->v != expected ||
+                (picorb_next(previous) != NULL && ((rb_int_node_t*)rb_int_node_value(picorb_next(previous)))->v <= key.v)))) {
+                DBG_PRINTF("Step %d, find previous %d fails\n", step, key.v);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Walk the tree both ways */
+        int nb_forward = 0;
+        int nb_backward = 0;
+        for (picorb_node_t* x = picorb_first(tree); x != NULL; x = picorb_next(x)) {
+            nb_forward++;
+        }
+        for (picorb_node_t* x = picorb_last(tree); x != NULL; x = picorb_previous(x)) {
+            nb_backward++;
+        }
+        if (nb_forward != nb_nodes || nb_backward != nb_nodes) {
+            DBG_PRINTF("Walk finds %d and %d nodes instead of %d\n", nb_forward, nb_backward, nb_nodes);
+            ret = -1;
+        }
+    }
+
+    if (tree != NULL) {
+        picorb_empty_tree(tree);
+        if (ret == 0 && (tree->root != NULL || tree->size != 0)) {
+            DBG_PRINTF("%s", "Tree not empty after emptying.\n");
+            ret = -1;
+        }
+        free(tree);
+    }
+
+    return ret;
+}
+
+/* Benchmark of the tree structures, for the access patterns of the current
+ * users of picosplay. Each pattern is run with the splay tree using
+ * picosplay_find, with the splay tree using picosplay_lookup, and with the
+ * red-black tree. The durations are printed, and the test verifies that the
+ * three variants find the same nodes.
+ */
+#define TREE_BENCH_NB_NODES 1024
+#define TREE_BENCH_NB_OPS 100000
+
+typedef enum {
+    tree_bench_splay_find = 0,
+    tree_bench_splay_lookup,
+    tree_bench_rb,
+    tree_bench_nb_methods
+} tree_bench_method_enum;
+
+typedef struct st_tree_bench_node_t {
+    uint64_t key;
+    picosplay_node_t s_node;
+    picorb_node_t r_node;
+} tree_bench_node_t;
+
+typedef struct st_tree_bench_ctx_t {
+    tree_bench_method_enum method;
+    picosplay_tree_t s_tree;
+    picorb_tree_t r_tree;
+    tree_bench_node_t* nodes;
+} tree_bench_ctx_t;
+
+static int64_t tree_bench_compare(void* l, void* r)
+{
+    uint64_t k_l = ((tree_bench_node_t*)l)->key;
+    uint64_t k_r = ((tree_bench_node_t*)r)->key;
+
+    return (k_l < k_r) ? -1 : ((k_l > k_r) ? 1 : 0);
+}
+
+static picosplay_node_t* tree_bench_s_create(void* value)
+{
+    return &((tree_bench_node_t*)value)->s_node;
+}
+
+static void* tree_bench_s_value(picosplay_node_t* node)
+{
+    return (void*)((char*)node - offsetof(struct st_tree_bench_node_t, s_node));
+}
+
+static picorb_node_t* tree_bench_r_create(void* value)
+{
+    return &((tree_bench_node_t*)value)->r_node;
+}
+
+static void* tree_bench_r_value(picorb_node_t* node)
+{
+    return (void*)((char*)node - offsetof(struct st_tree_bench_node_t, r_node));
+}
+
+/* Nodes are owned by the node array */
+static void tree_bench_s_delete(void* tree, picosplay_node_t* node)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(tree);
+    UNREFERENCED_PARAMETER(node);
+#endif
+}
+
+static void tree_bench_r_delete(void* tree, picorb_node_t* node)
+{
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(tree);
+    UNREFERENCED_PARAMETER(node);
+#endif
+}
+
+static void tree_bench_insert(tree_bench_ctx_t* ctx, tree_bench_node_t* node)
+{
+    if (ctx->method == tree_bench_rb) {
+        (void)picorb_insert(&ctx->r_tree, node);
+    }
+    else {
+        (void)picosplay_insert(&ctx->s_tree, node);
+    }
+}
+
+static tree_bench_node_t* tree_bench_find(tree_bench_ctx_t* ctx, uint64_t key)
+{
+    tree_bench_node_t target;
+    void* found = NULL;
+
+    target.key = key;
+    if (ctx->method == tree_bench_rb) {
+        picorb_node_t* r_node = picorb_find(&ctx->r_tree, &target);
+        found = (r_node == NULL) ? NULL : tree_bench_r_value(r_node);
+    }
+    else {
+        picosplay_node_t* s_node = (ctx->method == tree_bench_splay_find) ?
+            picosplay_find(&ctx->s_tree, &target) : picosplay_lookup(&ctx->s_tree, &target);
+        found = (s_node == NULL) ? NULL : tree_bench_s_value(s_node);
+    }
+    return (tree_bench_node_t*)found;
+}
+
+static tree_bench_node_t* tree_bench_find_previous(tree_bench_ctx_t* ctx, uint64_t key)
+{
+    tree_bench_node_t target;
+    void* found = NULL;
+
+    target.key = key;
+    if (ctx->method == tree_bench_rb) {
+        picorb_node_t* r_node = picorb_find_previous(&ctx->r_tree, &target);
+        found = (r_node == NULL) ? NULL : tree_bench_r_value(r_node);
+    }
+    else {
+        picosplay_node_t* s_node = picosplay_find_previous(&ctx->s_tree, &target);
+        found = (s_node == NULL) ? NULL : tree_bench_s_value(s_node);
+    }
+    return (tree_bench_node_t*)found;
+}
+
+static tree_bench_node_t* tree_bench_first(tree_bench_ctx_t* ctx)
+{
+    void* found = NULL;
+
+    if (ctx->method == tree_bench_rb) {
+        picorb_node_t* r_node = picorb_first(&ctx->r_tree);
+        found = (r_node == NULL) ? NULL : tree_bench_r_value(r_node);
+    }
+    else {
+        picosplay_node_t* s_node = picosplay_first(&ctx->s_tree);
+        found = (s_node == NULL) ? NULL : tree_bench_s_value(s_node);
+    }
+    return (tree_bench_node_t*)found;
+}
+
+static void tree_bench_remove(tree_bench_ctx_t* ctx, tree_bench_node_t* node)
+{
+    if (ctx->method == tree_bench_rb) {
+        picorb_delete_hint(&ctx->r_tree, &node->r_node);
+    }
+    else {
+        picosplay_delete_hint(&ctx->s_tree, &node->s_node);
+    }
+}
+
+typedef enum {
+    tree_bench_streams = 0, /* random lookups of stream ID among many streams */
+    tree_bench_stream_data, /* chunks added at the end, mostly in order, consumed from the front */
+    tree_bench_sacks, /* range lookups with find previous, few updates */
+    tree_bench_tokens, /* random keys, inserted, checked once, removed */
+    tree_bench_wake_list, /* priority queue of wake times */
+    tree_bench_data_repeat, /* ordered queue, removal from the middle after lookup */
+    tree_bench_h3_streams, /* a few streams, same stream looked up repeatedly */
+    tree_bench_nb_patterns
+} tree_bench_pattern_enum;
+
+static const char* tree_bench_pattern_name[tree_bench_nb_patterns] = {
+    "streams", "stream data", "sacks", "tokens", "wake list", "data repeat", "h3 streams" };
+
+/* Run one pattern, and return a checksum of the nodes found */
+static uint64_t tree_bench_run(tree_bench_ctx_t* ctx, tree_bench_pattern_enum pattern)
+{
+    uint64_t random_ctx = 0x0123456789abcdefull + (uint64_t)pattern;
+    uint64_t checksum = 0;
+    uint64_t next_key = 0;
+    size_t nb_nodes = (pattern == tree_bench_h3_streams) ? 16 : TREE_BENCH_NB_NODES;
+
+    for (size_t i = 0; i < nb_nodes; i++) {
+        switch (pattern) {
+        case tree_bench_streams:
+        case tree_bench_h3_streams:
+        case tree_bench_sacks:
+            ctx->nodes[i].key = 4 * i;
+            break;
+        case tree_bench_stream_data:
+        case tree_bench_data_repeat:
+            /* Mostly in order, with some swaps as in reordered packets */
+            ctx->nodes[i].key = 1000 * (((i & 7) == 3) ? i + 1 : (((i & 7) == 4) ? i - 1 : i));
+            break;
+        default:
+            ctx->nodes[i].key = picoquic_test_random(&random_ctx);
+            break;
+        }
+        tree_bench_insert(ctx, &ctx->nodes[i]);
+    }
+    next_key = 1000 * nb_nodes;
+
+    for (int op = 0; op < TREE_BENCH_NB_OPS; op++) {
+        tree_bench_node_t* node = NULL;
+        size_t rank = (size_t)picoquic_test_uniform_random(&random_ctx, nb_nodes);
+
+        switch (pattern) {
+        case tree_bench_streams:
+            node = tree_bench_find(ctx, 4 * rank);
+            break;
+        case tree_bench_h3_streams:
+            /* Several lookups for the same stream in a row */
+            node = tree_bench_find(ctx, 4 * (((size_t)op / 8) % nb_nodes));
+            break;
+        case tree_bench_sacks:
+            node = tree_bench_find_previous(ctx, 4 * rank + (uint64_t)(op & 3));
+            if ((op & 63) == 0 && node != NULL) {
+                /* Occasional range update */
+                tree_bench_remove(ctx, node);
+                tree_bench_insert(ctx, node);
+            }
+            break;
+        case tree_bench_tokens:
+            node = tree_bench_find(ctx, ctx->nodes[rank].key);
+            if (node != NULL) {
+                tree_bench_remove(ctx, node);
+                node->key = picoquic_test_random(&random_ctx);
+                tree_bench_insert(ctx, node);
+            }
+            break;
+        case tree_bench_wake_list:
+            if ((node = tree_bench_first(ctx)) != NULL) {
+                tree_bench_remove(ctx, node);
+                node->key += 1 + picoquic_test_uniform_random(&random_ctx, 100000);
+                tree_bench_insert(ctx, node);
+            }
+            break;
+        case tree_bench_stream_data:
+            if ((node = tree_bench_first(ctx)) != NULL) {
+                tree_bench_remove(ctx, node);
+                node->key = next_key;
+                next_key += 1000;
+                tree_bench_insert(ctx, node);
+            }
+            break;
+        case tree_bench_data_repeat:
+            node = tree_bench_find(ctx, ctx->nodes[rank].key);
+            if (node != NULL) {
+                tree_bench_remove(ctx, node);
+                node->key = next_key;
+                next_key += 1000;
+                tree_bench_insert(ctx, node);
+            }
+            break;
+        default:
+            break;
+        }
+        if (node != NULL) {
+            checksum += node->key;
+        }
+    }
+
+    for (size_t i = 0; i < nb_nodes; i++) {
+        tree_bench_remove(ctx, &ctx->nodes[i]);
+    }
+
+    return checksum;
+}
+
+int splay_bench_test()
+{
+    int ret = 0;
+    tree_bench_ctx_t ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.nodes = (tree_bench_node_t*)malloc(TREE_BENCH_NB_NODES * sizeof(tree_bench_node_t));
+    if (ctx.nodes == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(ctx.nodes, 0, TREE_BENCH_NB_NODES * sizeof(tree_bench_node_t));
+        picosplay_init_tree(&ctx.s_tree, tree_bench_compare, tree_bench_s_create, tree_bench_s_delete, tree_bench_s_value);
+        picorb_init_tree(&ctx.r_tree, tree_bench_compare, tree_bench_r_create, tree_bench_r_delete, tree_bench_r_value);
+    }
+
+    for (int pattern = 0; ret == 0 && pattern < tree_bench_nb_patterns; pattern++) {
+        uint64_t checksum[tree_bench_nb_methods];
+        uint64_t duration[tree_bench_nb_methods];
+
+        for (int method = 0; method < tree_bench_nb_methods; method++) {
+            uint64_t start_time = picoquic_current_time();
+
+            ctx.method = (tree_bench_method_enum)method;
+            checksum[method] = tree_bench_run(&ctx, (tree_bench_pattern_enum)pattern);
+            duration[method] = picoquic_current_time() - start_time;
+        }
+
+        if (ctx.s_tree.size != 0 || ctx.r_tree.size != 0 ||
+            checksum[tree_bench_splay_lookup] != checksum[tree_bench_splay_find] ||
+            checksum[tree_bench_rb] != checksum[tree_bench_splay_find]) {
+            DBG_PRINTF("Tree variants disagree for %s", tree_bench_pattern_name[pattern]);
+            ret = -1;
+        }
+        else {
+            DBG_PRINTF("%s, %d operations: splay find %" PRIu64 "us, splay lookup %" PRIu64 "us, red-black %" PRIu64 "us",
+                tree_bench_pattern_name[pattern], TREE_BENCH_NB_OPS,
+                duration[tree_bench_splay_find], duration[tree_bench_splay_lookup], duration[tree_bench_rb]);
+        }
+    }
+
+    if (ctx.nodes != NULL) {
+        free(ctx.nodes);
+    }
+
+    return ret;
+}
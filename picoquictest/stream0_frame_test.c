@@ -597,6 +597,146 @@ int stream_splay_test()
     return ret;
 }
 
+/* Test the stream index: create many streams of the four types, deleting
+ * old ones as in a workload of short streams, and verify that lookups and
+ * ordered iteration remain consistent with the stream tree. A stream far
+ * beyond the index window is kept only in the tree.
+ */
+static int stream_index_check(picoquic_cnx_t* cnx, uint64_t first_id, uint64_t last_id)
+{
+    int ret = 0;
+    picoquic_stream_head_t* stream = picoquic_first_stream(cnx);
+    uint64_t previous_id = 0;
+    int count = 0;
+
+    while (ret == 0 && stream != NULL) {
+        if (count > 0 && stream->stream_id <= previous_id) {
+            DBG_PRINTF("Stream %" PRIu64 " out of order after %" PRIu64, stream->stream_id, previous_id);
+            ret = -1;
+        }
+        else if (picoquic_find_stream(cnx, stream->stream_id) != stream) {
+            DBG_PRINTF("Cannot find stream %" PRIu64, stream->stream_id);
+            ret = -1;
+        }
+        previous_id = stream->stream_id;
+        count++;
+        stream = picoquic_next_stream(stream);
+    }
+
+    if (ret == 0 && count != cnx->stream_tree.size) {
+        DBG_PRINTF("Found %d streams, tree size %d", count, cnx->stream_tree.size);
+        ret = -1;
+    }
+
+    for (uint64_t stream_id = first_id; ret == 0 && stream_id <= last_id; stream_id++) {
+        picoquic_stream_head_t target;
+        target.stream_id = stream_id;
+        if (picoquic_find_stream(cnx, stream_id) != (picoquic_stream_head_t*)picosplay_find(&cnx->stream_tree, &target)) {
+            DBG_PRINTF("Index and tree differ for stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int stream_index_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    const uint64_t nb_streams = 20000;
+    const uint64_t nb_kept = 100;
+    const uint64_t far_stream_id = 4 * (uint64_t)PICORADIX_PAGE_SIZE * PICORADIX_MAX_PAGES * 8 + 2;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else {
+        cnx = picoquic_create_cnx(quic,
+            picoquic_null_connection_id, picoquic_null_connection_id, (struct sockaddr*)&saddr,
+            simulated_time, 0, "test-sni", "test-alpn", 1);
+
+        if (cnx == NULL) {
+            DBG_PRINTF("%s", "Cannot create connection\n");
+            ret = -1;
+        }
+    }
+
+    for (uint64_t stream_id = 0; ret == 0 && stream_id < nb_streams; stream_id++) {
+        if (picoquic_create_stream(cnx, stream_id) == NULL) {
+            DBG_PRINTF("Cannot create stream %" PRIu64, stream_id);
+            ret = -1;
+        }
+        else if (stream_id >= nb_kept) {
+            picoquic_stream_head_t* old_stream = picoquic_find_stream(cnx, stream_id - nb_kept);
+
+            if (old_stream == NULL) {
+                DBG_PRINTF("Cannot find stream %" PRIu64, stream_id - nb_kept);
+                ret = -1;
+            }
+            else {
+                picoquic_delete_stream(cnx, old_stream);
+            }
+        }
+        if (ret == 0 && stream_id % 1000 == 999) {
+            ret = stream_index_check(cnx, (stream_id > 2 * nb_kept) ? stream_id - 2 * nb_kept : 0, stream_id + 8);
+        }
+    }
+
+    if (ret == 0) {
+        size_t pages = 0;
+        for (int i = 0; i < 4; i++) {
+            pages += cnx->stream_index[i].nb_pages;
+        }
+        if (pages > 4 * (nb_kept / (4 * PICORADIX_PAGE_SIZE) + 2) || cnx->nb_streams_not_indexed != 0) {
+            DBG_PRINTF("Stream index uses %" PRIst " pages, %" PRIst " streams not indexed", pages, cnx->nb_streams_not_indexed);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        picoquic_stream_head_t* far_stream = picoquic_create_stream(cnx, far_stream_id);
+
+        if (far_stream == NULL || cnx->nb_streams_not_indexed != 1 ||
+            picoquic_find_stream(cnx, far_stream_id) != far_stream ||
+            picoquic_last_stream(cnx) != far_stream) {
+            DBG_PRINTF("%s", "Stream outside the index window not handled");
+            ret = -1;
+        }
+        else {
+            ret = stream_index_check(cnx, nb_streams - nb_kept, nb_streams + 8);
+            if (ret == 0) {
+                picoquic_delete_stream(cnx, far_stream);
+                if (cnx->nb_streams_not_indexed != 0 || picoquic_find_stream(cnx, far_stream_id) != NULL) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
 /* Test that the list of active streams is properly maintained */
 
 static int stream_output_test_callback(picoquic_cnx_t* cnx,
@@ -853,6 +993,379 @@ int stream_output_test()
     return ret;
 }
 
+/* Verify the consistency of the output buckets with the output list
+ */
+static int stream_scheduler_check(picoquic_cnx_t* cnx)
+{
+    int ret = 0;
+    size_t nb_levels = 0;
+    picoquic_stream_head_t* stream = cnx->first_output_stream;
+
+    while (ret == 0 && stream != NULL) {
+        picoquic_stream_head_t* previous = stream->previous_output_stream;
+        picoquic_stream_head_t* next = stream->next_output_stream;
+        uint8_t priority = stream->output_priority;
+
+        if (next != NULL && next->output_priority < priority) {
+            DBG_PRINTF("Stream %d listed after stream %d", (int)next->stream_id, (int)stream->stream_id);
+            ret = -1;
+        }
+        else if (nb_levels >= cnx->nb_output_buckets || cnx->output_buckets[nb_levels].priority != priority ||
+            (cnx->output_bucket_map[priority / 64] & (1ull << (priority % 64))) == 0) {
+            DBG_PRINTF("No bucket for level %d", (int)priority);
+            ret = -1;
+        }
+        else if ((previous == NULL || previous->output_priority != priority) && cnx->output_buckets[nb_levels].first != stream) {
+            DBG_PRINTF("Stream %d should be first of its bucket", (int)stream->stream_id);
+            ret = -1;
+        }
+        else if (next == NULL || next->output_priority != priority) {
+            if (cnx->output_buckets[nb_levels].last != stream) {
+                DBG_PRINTF("Stream %d should be last of its bucket", (int)stream->stream_id);
+                ret = -1;
+            }
+            nb_levels++;
+        }
+        stream = next;
+    }
+
+    if (ret == 0 && nb_levels != cnx->nb_output_buckets) {
+        DBG_PRINTF("%d buckets for %d levels", (int)cnx->nb_output_buckets, (int)nb_levels);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int stream_scheduler_expect(picoquic_cnx_t* cnx, size_t nb_output, uint64_t* output, uint64_t ready_id)
+{
+    int ret = stream_scheduler_check(cnx);
+
+    if (ret == 0) {
+        ret = stream_output_test_list(cnx, nb_output, output);
+    }
+
+    if (ret == 0) {
+        picoquic_stream_head_t* stream = picoquic_find_ready_stream(cnx);
+        if (stream == NULL || stream->stream_id != ready_id) {
+            DBG_PRINTF("Expected ready stream %d, got %d", (int)ready_id, (stream == NULL) ? -1 : (int)stream->stream_id);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Serve a stream as the sender would, updating its position in round robin levels */
+static void stream_scheduler_serve(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t current_time)
+{
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+
+    if (stream != NULL) {
+        stream->last_time_data_sent = current_time;
+        picoquic_requeue_output_stream(cnx, stream);
+    }
+}
+
+int stream_scheduler_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    const uint64_t nb_streams = 256;
+    uint64_t output1[] = { 4, 16, 20, 8, 0, 12 };
+    uint64_t output2[] = { 16, 20, 4, 8, 0, 12 };
+    uint64_t output3[] = { 20, 4, 16, 8, 0, 12 };
+    uint64_t output4[] = { 4, 16, 8, 0, 12, 20 };
+    uint64_t output5[] = { 16, 4, 8, 0, 12, 20 };
+    uint64_t output6[] = { 8, 0, 12, 20 };
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&saddr, simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+        ret = -1;
+    }
+    else {
+        picoquic_set_callback(cnx, stream_output_test_callback, NULL);
+        cnx->maxdata_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+        cnx->remote_parameters.initial_max_stream_data_bidi_remote = PICOQUIC_DEFAULT_0RTT_WINDOW;
+        cnx->max_stream_id_bidir_remote = 4 * (nb_streams + 8);
+
+        for (uint64_t stream_id = 0; ret == 0 && stream_id <= 20; stream_id += 4) {
+            if (picoquic_create_stream(cnx, stream_id) == NULL ||
+                picoquic_mark_active_stream(cnx, stream_id, 1, NULL) != 0) {
+                ret = -1;
+            }
+        }
+        /* Round robin level 2, FIFO levels 5 and default */
+        if (ret == 0 && (picoquic_set_stream_priority(cnx, 20, 2) != 0 ||
+            picoquic_set_stream_priority(cnx, 4, 2) != 0 ||
+            picoquic_set_stream_priority(cnx, 16, 2) != 0 ||
+            picoquic_set_stream_priority(cnx, 8, 5) != 0)) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = stream_scheduler_expect(cnx, 6, output1, 4);
+        }
+        if (ret == 0) {
+            stream_scheduler_serve(cnx, 4, 1000);
+            ret = stream_scheduler_expect(cnx, 6, output2, 16);
+        }
+        if (ret == 0) {
+            stream_scheduler_serve(cnx, 16, 2000);
+            ret = stream_scheduler_expect(cnx, 6, output3, 20);
+        }
+        if (ret == 0) {
+            /* Serving a FIFO stream does not change the order */
+            stream_scheduler_serve(cnx, 0, 3000);
+            ret = stream_scheduler_expect(cnx, 6, output3, 20);
+        }
+        if (ret == 0) {
+            /* Moving a stream to another level */
+            ret = picoquic_set_stream_priority(cnx, 20, PICOQUIC_DEFAULT_STREAM_PRIORITY);
+            if (ret == 0) {
+                ret = stream_scheduler_expect(cnx, 6, output4, 4);
+            }
+        }
+        if (ret == 0) {
+            /* A pending reset goes first */
+            ret = picoquic_reset_stream(cnx, 16, 0);
+            if (ret == 0) {
+                ret = stream_scheduler_expect(cnx, 6, output5, 16);
+            }
+        }
+        if (ret == 0) {
+            /* Emptying a level removes its bucket */
+            picoquic_remove_output_stream(cnx, picoquic_find_stream(cnx, 4));
+            picoquic_remove_output_stream(cnx, picoquic_find_stream(cnx, 16));
+            ret = stream_scheduler_expect(cnx, 4, output6, 8);
+            if (ret == 0 && cnx->nb_output_buckets != 2) {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            /* Many streams in a round robin level are served in turn */
+            uint64_t first_id = 24;
+
+            for (uint64_t i = 0; ret == 0 && i < nb_streams; i++) {
+                picoquic_create_stream(cnx, first_id + 4 * i);
+                if (picoquic_set_stream_priority(cnx, first_id + 4 * i, 0) != 0 ||
+                    picoquic_mark_active_stream(cnx, first_id + 4 * i, 1, NULL) != 0) {
+                    ret = -1;
+                }
+            }
+            for (uint64_t i = 0; ret == 0 && i < 2 * nb_streams; i++) {
+                picoquic_stream_head_t* stream = picoquic_find_ready_stream(cnx);
+                uint64_t expected = first_id + 4 * (i % nb_streams);
+
+                if (stream == NULL || stream->stream_id != expected) {
+                    DBG_PRINTF("Round %d, expected stream %d", (int)i, (int)expected);
+                    ret = -1;
+                }
+                else {
+                    stream_scheduler_serve(cnx, stream->stream_id, 10000 + i);
+                }
+            }
+            if (ret == 0) {
+                ret = stream_scheduler_check(cnx);
+            }
+        }
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Test the reassembly ring. Stream data is sent in out of order chunks, and
+ * should be delivered in one callback per contiguous run once the holes are
+ * filled, except when the run wraps around the end of the ring.
+ */
+typedef struct st_reassembly_ring_test_ctx_t {
+    uint8_t received[2048];
+    size_t length;
+    int nb_callbacks;
+} reassembly_ring_test_ctx_t;
+
+static int reassembly_ring_test_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx)
+{
+    int ret = 0;
+    reassembly_ring_test_ctx_t* ctx = (reassembly_ring_test_ctx_t*)callback_ctx;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(cnx);
+    UNREFERENCED_PARAMETER(stream_id);
+    UNREFERENCED_PARAMETER(v_stream_ctx);
+#endif
+
+    if (fin_or_event == picoquic_callback_stream_data || fin_or_event == picoquic_callback_stream_fin) {
+        if (ctx->length + length > sizeof(ctx->received)) {
+            ret = -1;
+        }
+        else {
+            memcpy(ctx->received + ctx->length, bytes, length);
+            ctx->length += length;
+            ctx->nb_callbacks++;
+        }
+    }
+
+    return ret;
+}
+
+static int reassembly_ring_test_chunk(picoquic_cnx_t* cnx, uint64_t offset, size_t length, uint64_t current_time)
+{
+    int ret = 0;
+    uint8_t frame[1024];
+    uint8_t* bytes = frame;
+    uint8_t* bytes_max = frame + sizeof(frame);
+
+    *bytes++ = picoquic_frame_type_stream_range_min | 6;
+    if ((bytes = picoquic_frames_varint_encode(bytes, bytes_max, 0)) == NULL ||
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, offset)) == NULL ||
+        (bytes = picoquic_frames_varint_encode(bytes, bytes_max, length)) == NULL ||
+        bytes + length > bytes_max) {
+        ret = -1;
+    }
+    else {
+        for (size_t i = 0; i < length; i++) {
+            *bytes++ = (uint8_t)(offset + i);
+        }
+        if (picoquic_decode_stream_frame(cnx, frame, bytes, NULL, current_time) == NULL) {
+            DBG_PRINTF("Cannot decode chunk at offset %" PRIu64, offset);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int stream_reassembly_ring_test()
+{
+    int ret = 0;
+    picoquic_quic_t* quic = NULL;
+    picoquic_cnx_t* cnx = NULL;
+    picoquic_stream_head_t* stream = NULL;
+    uint64_t simulated_time = 0;
+    struct sockaddr_in saddr;
+    reassembly_ring_test_ctx_t ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&saddr, 0, sizeof(struct sockaddr_in));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = 1000;
+
+    quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, NULL, simulated_time,
+        &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context\n");
+        ret = -1;
+    }
+    else if ((cnx = picoquic_create_cnx(quic, picoquic_null_connection_id, picoquic_null_connection_id,
+        (struct sockaddr*)&saddr, simulated_time, 0, "test-sni", "test-alpn", 1)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create connection\n");
+        ret = -1;
+    }
+    else {
+        cnx->client_mode = 0;
+        picoquic_set_callback(cnx, reassembly_ring_test_callback, &ctx);
+        if ((stream = picoquic_create_stream(cnx, 0)) == NULL) {
+            ret = -1;
+        }
+        else {
+            stream->maxdata_local = 1000;
+        }
+    }
+
+    /* 0..99 in order, 200..299 queued before the ring is created */
+    if (ret == 0 && (reassembly_ring_test_chunk(cnx, 0, 100, simulated_time) != 0 ||
+        reassembly_ring_test_chunk(cnx, 200, 100, simulated_time) != 0)) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        if (picoquic_set_stream_reassembly_ring(cnx, 0, 1000) != 0 ||
+            stream->reassembly_ring == NULL || stream->reassembly_ring->size != 1024 ||
+            picosplay_first(&stream->stream_data_tree) != NULL) {
+            DBG_PRINTF("%s", "Cannot set the reassembly ring");
+            ret = -1;
+        }
+        else if (picoquic_set_stream_reassembly_ring(cnx, 0, 1000) != PICOQUIC_ERROR_UNEXPECTED_STATE) {
+            DBG_PRINTF("%s", "Reassembly ring set twice");
+            ret = -1;
+        }
+    }
+
+    /* 300..999 are reassembled, then delivered with 100..199 */
+    for (uint64_t offset = 900; ret == 0 && offset >= 300; offset -= 100) {
+        ret = reassembly_ring_test_chunk(cnx, offset, 100, simulated_time);
+    }
+    if (ret == 0 && (ctx.nb_callbacks != 1 || picosplay_first(&stream->stream_data_tree) != NULL)) {
+        DBG_PRINTF("%d callbacks before filling the hole", ctx.nb_callbacks);
+        ret = -1;
+    }
+    if (ret == 0 && (reassembly_ring_test_chunk(cnx, 100, 100, simulated_time) != 0 ||
+        ctx.nb_callbacks != 3 || stream->consumed_offset != 1000)) {
+        DBG_PRINTF("%d callbacks after filling the hole", ctx.nb_callbacks);
+        ret = -1;
+    }
+
+    /* Open the window as a MAX STREAM DATA would, then create a run that wraps */
+    if (ret == 0) {
+        stream->maxdata_local = stream->consumed_offset + stream->reassembly_ring->size;
+        for (uint64_t offset = 1010; ret == 0 && offset < 1950; offset += 100) {
+            ret = reassembly_ring_test_chunk(cnx, offset, (offset + 100 > 1960) ? (size_t)(1960 - offset) : 100, simulated_time);
+        }
+        if (ret == 0 && (reassembly_ring_test_chunk(cnx, 1000, 10, simulated_time) != 0 ||
+            ctx.nb_callbacks != 6 || stream->consumed_offset != 1960)) {
+            DBG_PRINTF("%d callbacks after wrapping around", ctx.nb_callbacks);
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < ctx.length; i++) {
+        if (ctx.received[i] != (uint8_t)i) {
+            DBG_PRINTF("Byte %" PRIst " does not match", i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (cnx->cnx_state == picoquic_state_disconnecting || cnx->local_error != 0)) {
+        DBG_PRINTF("Connection error 0x%" PRIx64, cnx->local_error);
+        ret = -1;
+    }
+
+    if (cnx != NULL) {
+        picoquic_delete_cnx(cnx);
+    }
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
 /* Test the STREAM ID and STREAM RANK macros
  */
 
@@ -542,6 +542,428 @@ int token_reuse_api_test()
     return ret;
 }
 
+/* Token registry under load. Register many more tokens than the registry
+ * can hold, and verify that the memory stays bounded, that recent tokens
+ * are still detected as reused, and that clearing makes slots reusable.
+ */
+int token_registry_flood_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    size_t nb_tokens = 4 * PICOQUIC_TOKEN_REGISTRY_SHARDS * PICOQUIC_TOKEN_REGISTRY_SHARD_SLOTS;
+    picoquic_quic_t* quic = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+        NULL, 0, &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context");
+        ret = -1;
+    }
+    else {
+        uint8_t token[16];
+
+        memset(token, 0x5a, sizeof(token));
+        for (size_t i = 0; ret == 0 && i < nb_tokens; i++) {
+            picoformat_64(token + 8, (uint64_t)i);
+            if (picoquic_registered_token_check_reuse(quic, token, sizeof(token), 1000 + i / 1024) != 0) {
+                DBG_PRINTF("Token %zu reported as reused", i);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && quic->token_registry.nb_evicted == 0) {
+            DBG_PRINTF("%s", "Expected evictions when the registry is full");
+            ret = -1;
+        }
+
+        /* The most recent tokens have the latest expiry, and should not have been evicted */
+        for (size_t i = nb_tokens - 16; ret == 0 && i < nb_tokens; i++) {
+            picoformat_64(token + 8, (uint64_t)i);
+            if (picoquic_registered_token_check_reuse(quic, token, sizeof(token), 1000 + i / 1024) == 0) {
+                DBG_PRINTF("Token %zu not detected as reused", i);
+                ret = -1;
+            }
+        }
+
+        /* After clearing all expiry times, all slots are free again */
+        if (ret == 0) {
+            uint64_t nb_evicted = quic->token_registry.nb_evicted;
+
+            picoquic_registered_token_clear(quic, 1000 + nb_tokens);
+            for (size_t i = 0; ret == 0 && i < 1024; i++) {
+                picoformat_64(token + 8, (uint64_t)i);
+                if (picoquic_registered_token_check_reuse(quic, token, sizeof(token), 2000 + nb_tokens) != 0) {
+                    DBG_PRINTF("Token %zu reported as reused after clear", i);
+                    ret = -1;
+                }
+            }
+            if (ret == 0 && quic->token_registry.nb_evicted != nb_evicted) {
+                DBG_PRINTF("%s", "Unexpected evictions after clear");
+                ret = -1;
+            }
+        }
+
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Initial rate limiter. Packets from the same /24 share a bucket, other
+ * prefixes are not affected, and the bucket refills over time.
+ */
+int initial_rate_limit_test()
+{
+    int ret = 0;
+    uint64_t simulated_time = 0;
+    picoquic_quic_t* quic = picoquic_create(4, NULL, NULL, NULL, "test", NULL, NULL, NULL, NULL,
+        NULL, 0, &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        DBG_PRINTF("%s", "Cannot create QUIC context");
+        ret = -1;
+    }
+    else {
+        struct sockaddr_in addr_a;
+        struct sockaddr_in addr_b;
+        uint64_t current_time = 1000000;
+        int nb_accepted = 0;
+
+        memset(&addr_a, 0, sizeof(addr_a));
+        addr_a.sin_family = AF_INET;
+        memset(&addr_a.sin_addr, 10, 4);
+        addr_b = addr_a;
+        ((uint8_t*)&addr_b.sin_addr)[2] = 11;
+
+        /* Without limiter, everything is accepted */
+        for (int i = 0; ret == 0 && i < 100; i++) {
+            if (picoquic_initial_rate_check(quic, (struct sockaddr*)&addr_a, current_time) != 0) {
+                DBG_PRINTF("%s", "Packet limited without rate limiter");
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && (ret = picoquic_set_initial_rate_limit(quic, 10, 5)) != 0) {
+            DBG_PRINTF("Cannot set rate limit, ret = %d", ret);
+        }
+
+        /* The burst is accepted, then packets are limited, for the whole /24 */
+        for (int i = 0; ret == 0 && i < 20; i++) {
+            struct sockaddr_in addr_x = addr_a;
+
+            ((uint8_t*)&addr_x.sin_addr)[3] = (uint8_t)i;
+            if (picoquic_initial_rate_check(quic, (struct sockaddr*)&addr_x, current_time) == 0) {
+                nb_accepted++;
+            }
+        }
+        if (ret == 0 && nb_accepted != 5) {
+            DBG_PRINTF("Accepted %d packets instead of 5", nb_accepted);
+            ret = -1;
+        }
+        if (ret == 0 && picoquic_get_initial_rate_limited(quic) != 15) {
+            DBG_PRINTF("Limited %" PRIu64 " packets instead of 15", picoquic_get_initial_rate_limited(quic));
+            ret = -1;
+        }
+        /* After 200 ms, 2 more packets are accepted */
+        if (ret == 0) {
+            current_time += 200000;
+            nb_accepted = 0;
+            for (int i = 0; i < 5; i++) {
+                if (picoquic_initial_rate_check(quic, (struct sockaddr*)&addr_a, current_time) == 0) {
+                    nb_accepted++;
+                }
+            }
+            if (nb_accepted != 2) {
+                DBG_PRINTF("Accepted %d packets after refill instead of 2", nb_accepted);
+                ret = -1;
+            }
+        }
+        /* Another prefix is not affected */
+        if (ret == 0 && picoquic_initial_rate_check(quic, (struct sockaddr*)&addr_b, current_time) != 0) {
+            DBG_PRINTF("%s", "Other prefix limited");
+            ret = -1;
+        }
+
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify the indexed ticket and token stores: lookups among a large number
+ * of origins, least recently used eviction when the store is bounded, and
+ * recovery when the list is replaced without using the store API.
+ */
+#define TICKET_STORE_INDEX_NB 2048
+#define TICKET_STORE_INDEX_MAX 16
+
+static void ticket_store_index_sni(char* sni, size_t sni_max, size_t i)
+{
+    (void)picoquic_sprintf(sni, sni_max, NULL, "origin%zu.example.com", i);
+}
+
+static int ticket_store_index_add(picoquic_quic_t* quic, size_t i, uint64_t ticket_time)
+{
+    char sni[64];
+    uint8_t ticket[128];
+    uint8_t ip_addr[4] = { 10, 0, (uint8_t)(i >> 8), (uint8_t)i };
+    int ret = create_test_ticket(ticket_time / 1000, 100000, ticket, (uint16_t)sizeof(ticket));
+
+    ticket_store_index_sni(sni, sizeof(sni), i);
+    if (ret == 0) {
+        ret = picoquic_store_ticket(quic, sni, (uint16_t)strlen(sni), test_alpn[0], (uint16_t)strlen(test_alpn[0]),
+            test_version[0], ip_addr, 4, NULL, 0, ticket, (uint16_t)sizeof(ticket), &test_tp);
+    }
+    if (ret == 0) {
+        ret = picoquic_store_token(quic, sni, (uint16_t)strlen(sni), ip_addr, 4, ticket, 64);
+    }
+    return ret;
+}
+
+static int ticket_store_index_has(picoquic_quic_t* quic, size_t i)
+{
+    char sni[64];
+    uint8_t ip_addr[4] = { 10, 0, (uint8_t)(i >> 8), (uint8_t)i };
+    uint8_t* ticket = NULL;
+    uint16_t ticket_length = 0;
+    uint8_t* token = NULL;
+    uint16_t token_length = 0;
+    int has_ticket;
+    int has_token;
+
+    ticket_store_index_sni(sni, sizeof(sni), i);
+    has_ticket = (picoquic_get_ticket(quic, sni, (uint16_t)strlen(sni), test_alpn[0], (uint16_t)strlen(test_alpn[0]),
+        test_version[0], &ticket, &ticket_length, NULL, 0) == 0 && ticket_length == 128);
+    has_token = (picoquic_get_token(quic, sni, (uint16_t)strlen(sni), ip_addr, 4, &token, &token_length, 0) == 0 &&
+        token_length == 64);
+    if (token != NULL) {
+        free(token);
+    }
+
+    return (has_ticket && has_token) ? 1 : ((!has_ticket && !has_token) ? 0 : -1);
+}
+
+int ticket_store_index_test()
+{
+    int ret = 0;
+    uint64_t ticket_time = 40000000000ull;
+    uint64_t simulated_time = 50000000000ull;
+    picoquic_quic_t* quic = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL,
+        NULL, NULL, NULL, 0, &simulated_time, NULL, NULL, 0);
+
+    if (quic == NULL) {
+        ret = -1;
+    }
+
+    /* Many origins, all retrievable */
+    for (size_t i = 0; ret == 0 && i < TICKET_STORE_INDEX_NB; i++) {
+        ret = ticket_store_index_add(quic, i, ticket_time);
+    }
+    for (size_t i = 0; ret == 0 && i < TICKET_STORE_INDEX_NB; i++) {
+        if (ticket_store_index_has(quic, i) != 1) {
+            DBG_PRINTF("Cannot retrieve ticket or token #%zu", i);
+            ret = -1;
+        }
+    }
+    if (ret == 0 && (quic->ticket_index.nb_tickets != TICKET_STORE_INDEX_NB ||
+        quic->token_index.nb_tokens != TICKET_STORE_INDEX_NB)) {
+        DBG_PRINTF("Expected %d entries, got %zu tickets, %zu tokens", TICKET_STORE_INDEX_NB,
+            quic->ticket_index.nb_tickets, quic->token_index.nb_tokens);
+        ret = -1;
+    }
+
+    /* Bounding the store keeps the most recently used entries */
+    if (ret == 0) {
+        picoquic_set_ticket_store_max(quic, TICKET_STORE_INDEX_MAX);
+        picoquic_set_token_store_max(quic, TICKET_STORE_INDEX_MAX);
+        for (size_t i = 0; ret == 0 && i < TICKET_STORE_INDEX_NB; i++) {
+            int expected = (i >= TICKET_STORE_INDEX_NB - TICKET_STORE_INDEX_MAX) ? 1 : 0;
+            if (ticket_store_index_has(quic, i) != expected) {
+                DBG_PRINTF("Unexpected state of entry #%zu after eviction", i);
+                ret = -1;
+            }
+        }
+    }
+
+    /* Using the oldest entry protects it from the next eviction */
+    if (ret == 0) {
+        size_t oldest = TICKET_STORE_INDEX_NB - TICKET_STORE_INDEX_MAX;
+
+        (void)ticket_store_index_has(quic, oldest);
+        ret = ticket_store_index_add(quic, TICKET_STORE_INDEX_NB, ticket_time);
+        if (ret == 0 && (ticket_store_index_has(quic, oldest) != 1 ||
+            ticket_store_index_has(quic, oldest + 1) != 0 ||
+            ticket_store_index_has(quic, TICKET_STORE_INDEX_NB) != 1)) {
+            DBG_PRINTF("%s", "The least recently used entry was not evicted");
+            ret = -1;
+        }
+    }
+
+    /* The index follows a list replaced directly */
+    if (ret == 0) {
+        picoquic_stored_ticket_t* p_first_ticket = quic->p_first_ticket;
+        picoquic_stored_token_t* p_first_token = quic->p_first_token;
+
+        quic->p_first_ticket = NULL;
+        quic->p_first_token = NULL;
+        if (ticket_store_index_has(quic, TICKET_STORE_INDEX_NB) != 0) {
+            DBG_PRINTF("%s", "Entry found in an empty store");
+            ret = -1;
+        }
+        quic->p_first_ticket = p_first_ticket;
+        quic->p_first_token = p_first_token;
+        if (ret == 0 && ticket_store_index_has(quic, TICKET_STORE_INDEX_NB) != 1) {
+            DBG_PRINTF("%s", "Entry not found after restoring the store");
+            ret = -1;
+        }
+    }
+
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    return ret;
+}
+
+/* Verify that tickets and tokens stored by one context can be retrieved by
+ * another context attached to the same shared store, as would be the case
+ * for two processes, and that a used ticket is no longer shared.
+ */
+static char const* test_shared_store_file_name = "shared_ticket_store_test.bin";
+#define TEST_SHARED_STORE_SLOTS 64
+
+int shared_ticket_store_test()
+{
+    int ret = 0;
+    uint64_t ticket_time = 40000000000ull;
+    uint64_t simulated_time = 50000000000ull;
+    picoquic_quic_t* quic[3] = { NULL, NULL, NULL };
+    uint8_t ip_addr[4] = { 10, 0, 0, 1 };
+    uint8_t ticket[128];
+    char const* sni = test_sni[0];
+    char const* alpn = test_alpn[0];
+
+    (void)remove(test_shared_store_file_name);
+
+    for (int i = 0; ret == 0 && i < 3; i++) {
+        quic[i] = picoquic_create(8, NULL, NULL, NULL, NULL, NULL, NULL,
+            NULL, NULL, NULL, 0, &simulated_time, NULL, NULL, 0);
+        if (quic[i] == NULL) {
+            ret = -1;
+        }
+        else if ((ret = picoquic_attach_shared_ticket_store(quic[i], test_shared_store_file_name, TEST_SHARED_STORE_SLOTS)) != 0) {
+            DBG_PRINTF("Cannot attach shared store, context %d, ret 0x%x", i, ret);
+        }
+    }
+
+    /* A store that does not match the file size cannot be attached */
+    if (ret == 0 && picoquic_attach_shared_ticket_store(quic[2], test_shared_store_file_name, 2 * TEST_SHARED_STORE_SLOTS) == 0) {
+        DBG_PRINTF("%s", "Attached a shared store with the wrong number of slots");
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = picoquic_attach_shared_ticket_store(quic[2], test_shared_store_file_name, TEST_SHARED_STORE_SLOTS);
+    }
+
+    /* Store a ticket and a token in the first context */
+    if (ret == 0) {
+        ret = create_test_ticket(ticket_time / 1000, 100000, ticket, (uint16_t)sizeof(ticket));
+    }
+    if (ret == 0) {
+        ret = picoquic_store_ticket(quic[0], sni, (uint16_t)strlen(sni), alpn, (uint16_t)strlen(alpn),
+            test_version[0], ip_addr, 4, NULL, 0, ticket, (uint16_t)sizeof(ticket), &test_tp);
+    }
+    if (ret == 0) {
+        ret = picoquic_store_token(quic[0], sni, (uint16_t)strlen(sni), ip_addr, 4, ticket, 64);
+    }
+
+    /* Retrieve them in the second context, and mark the ticket used */
+    if (ret == 0) {
+        uint8_t* p_ticket = NULL;
+        uint16_t ticket_length = 0;
+        uint8_t* token = NULL;
+        uint16_t token_length = 0;
+        picoquic_tp_t tp;
+
+        memset(&tp, 0, sizeof(tp));
+        if (picoquic_get_ticket(quic[1], sni, (uint16_t)strlen(sni), alpn, (uint16_t)strlen(alpn),
+            test_version[0], &p_ticket, &ticket_length, &tp, 1) != 0 ||
+            ticket_length != sizeof(ticket) || memcmp(p_ticket, ticket, sizeof(ticket)) != 0 ||
+            tp.initial_max_data != test_tp.initial_max_data) {
+            DBG_PRINTF("%s", "Shared ticket not found");
+            ret = -1;
+        }
+        else if (picoquic_get_token(quic[1], sni, (uint16_t)strlen(sni), NULL, 0, &token, &token_length, 0) != 0 ||
+            token_length != 64 || memcmp(token, ticket, 64) != 0) {
+            DBG_PRINTF("%s", "Shared token not found");
+            ret = -1;
+        }
+        if (token != NULL) {
+            free(token);
+        }
+    }
+
+    /* The used ticket is not available to the third context, the token is */
+    if (ret == 0) {
+        uint8_t* p_ticket = NULL;
+        uint16_t ticket_length = 0;
+        uint8_t* token = NULL;
+        uint16_t token_length = 0;
+
+        if (picoquic_get_ticket(quic[2], sni, (uint16_t)strlen(sni), alpn, (uint16_t)strlen(alpn),
+            test_version[0], &p_ticket, &ticket_length, NULL, 0) == 0) {
+            DBG_PRINTF("%s", "Used ticket is still shared");
+            ret = -1;
+        }
+        else if (picoquic_get_token(quic[2], sni, (uint16_t)strlen(sni), ip_addr, 4, &token, &token_length, 0) != 0 ||
+            token_length != 64) {
+            DBG_PRINTF("%s", "Shared token not found by IP address");
+            ret = -1;
+        }
+        if (token != NULL) {
+            free(token);
+        }
+    }
+
+    /* Detaching stops the sharing, and entries expire from the shared store */
+    if (ret == 0) {
+        uint8_t* token = NULL;
+        uint16_t token_length = 0;
+
+        picoquic_detach_shared_ticket_store(quic[2]);
+        picoquic_free_tokens(&quic[2]->p_first_token);
+        if (picoquic_get_token(quic[2], sni, (uint16_t)strlen(sni), ip_addr, 4, &token, &token_length, 0) == 0) {
+            DBG_PRINTF("%s", "Token found after detaching the shared store");
+            ret = -1;
+        }
+        if (token != NULL) {
+            free(token);
+            token = NULL;
+        }
+        if (ret == 0) {
+            ret = picoquic_attach_shared_ticket_store(quic[2], test_shared_store_file_name, TEST_SHARED_STORE_SLOTS);
+        }
+        if (ret == 0) {
+            simulated_time += 48ull * 3600ull * 1000000ull;
+            if (picoquic_get_token(quic[2], sni, (uint16_t)strlen(sni), ip_addr, 4, &token, &token_length, 0) == 0) {
+                DBG_PRINTF("%s", "Expired token found in the shared store");
+                ret = -1;
+            }
+            if (token != NULL) {
+                free(token);
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (quic[i] != NULL) {
+            picoquic_free(quic[i]);
+        }
+    }
+    (void)remove(test_shared_store_file_name);
+
+    return ret;
+}
+
 /* Ticket seed. Do a connection, and verify that server and client have properly
  * documented the congestion parameters in the outgoing or incoming tickets
  */
@@ -935,6 +935,104 @@ int transport_param_test()
     return ret;
 }
 
+/*
+ * Verify the server transport parameter cache. The first connection fills
+ * the cache, the second one with the same local parameters reuses it, and
+ * its encoding must be identical to the one obtained without the cache.
+ * Changing a local parameter must cause a miss and refresh the cache.
+ */
+int transport_param_cache_test()
+{
+    int ret;
+    picoquic_quic_t* quic_ctx = NULL;
+    picoquic_cnx_t* test_cnx = NULL;
+    picoquic_cnx_t* second_cnx = NULL;
+    picoquic_connection_id_t initial_cnx_id = { { 0xca, 0xc4, 0xe0, 1, 2, 3, 4, 5, 6, 7, 8 }, 11 };
+    picoquic_connection_id_t remote_cnx_id = { { 0xca, 0xc4, 0xe0, 9, 10 }, 5 };
+    struct sockaddr_in addr;
+    uint8_t buffer[256];
+    uint8_t cached[256];
+    size_t encoded = 0;
+    size_t cached_encoded = 0;
+    uint64_t simulated_time = 0;
+
+    ret = transport_param_set_contexts(&quic_ctx, &test_cnx, &simulated_time, 1);
+
+    if (ret == 0) {
+        memcpy(&test_cnx->local_parameters, &transport_param_test4, sizeof(picoquic_tp_t));
+        test_cnx->is_hcid_verified = 1;
+        ret = picoquic_prepare_transport_extensions(test_cnx, 1, buffer, sizeof(buffer), &encoded);
+        if (ret == 0 && (quic_ctx->tp_cache == NULL || quic_ctx->tp_cache->nb_hits != 0)) {
+            DBG_PRINTF("%s", "Transport parameter cache not filled\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        memset(&addr, 0, sizeof(struct sockaddr_in));
+        addr.sin_family = AF_INET;
+        addr.sin_port = 4433;
+        second_cnx = picoquic_create_cnx(quic_ctx, initial_cnx_id, remote_cnx_id,
+            (struct sockaddr*)&addr, 0, 0, NULL, NULL, 0);
+        if (second_cnx == NULL) {
+            ret = -1;
+        }
+        else {
+            memcpy(&second_cnx->local_parameters, &transport_param_test4, sizeof(picoquic_tp_t));
+            second_cnx->version_index = test_cnx->version_index;
+            second_cnx->is_hcid_verified = 1;
+            ret = picoquic_prepare_transport_extensions(second_cnx, 1, cached, sizeof(cached), &cached_encoded);
+            if (ret == 0 && quic_ctx->tp_cache->nb_hits != 1) {
+                DBG_PRINTF("%s", "Transport parameter cache not used\n");
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* Encode the same parameters without the cache, compare */
+        picoquic_tp_cache_free(quic_ctx);
+        ret = picoquic_prepare_transport_extensions(second_cnx, 1, buffer, sizeof(buffer), &encoded);
+        if (ret == 0 && (encoded != cached_encoded || memcmp(buffer, cached, encoded) != 0)) {
+            DBG_PRINTF("%s", "Cached transport parameters differ\n");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* A different parameter value is a miss, and refreshes the cache */
+        second_cnx->local_parameters.initial_max_data += 1;
+        ret = picoquic_prepare_transport_extensions(second_cnx, 1, cached, sizeof(cached), &cached_encoded);
+        if (ret == 0 && (quic_ctx->tp_cache->nb_hits != 0 ||
+            (cached_encoded == encoded && memcmp(buffer, cached, encoded) == 0))) {
+            DBG_PRINTF("%s", "Transport parameter cache used after parameter change\n");
+            ret = -1;
+        }
+        else if (ret == 0) {
+            picoquic_tp_cache_free(quic_ctx);
+            ret = picoquic_prepare_transport_extensions(second_cnx, 1, buffer, sizeof(buffer), &encoded);
+            if (ret == 0 && (encoded != cached_encoded || memcmp(buffer, cached, encoded) != 0)) {
+                DBG_PRINTF("%s", "Parameter change not encoded\n");
+                ret = -1;
+            }
+        }
+    }
+
+    if (second_cnx != NULL) {
+        picoquic_delete_cnx(second_cnx);
+    }
+
+    if (test_cnx != NULL) {
+        picoquic_delete_cnx(test_cnx);
+    }
+
+    if (quic_ctx != NULL) {
+        picoquic_free(quic_ctx);
+    }
+
+    return ret;
+}
+
 /*
  * Verify that we can properly log all the transport parameters.
  */
@@ -273,6 +273,125 @@ int picowt_baton_random_test()
     return ret;
 }
 
+/* Benchmark mode: several sessions on the same connection, fixed
+ * message size, several datagrams per turn. Verify that all sessions
+ * complete and that the message latencies are recorded.
+ */
+int picowt_baton_bench_test()
+{
+    char const* alpn = "h3";
+    char const* baton_path = "/baton?baton=200&count=2&size=1000&dgram=2&dsize=200";
+    size_t nb_sessions = 3;
+    uint64_t simulated_time = 0;
+    uint64_t loss_mask = 0;
+    uint64_t time_out;
+    int nb_trials = 0;
+    int was_active = 0;
+    picoquic_test_tls_api_ctx_t* test_ctx = NULL;
+    wt_baton_bench_t* bench = NULL;
+    int ret = 0;
+    picohttp_server_parameters_t server_param = { 0 };
+    picoquic_connection_id_t initial_cid = { {0x77, 0x74, 0xba, 0xbe, 0, 0, 0, 0}, 8 };
+    h3zero_callback_ctx_t* h3zero_cb = NULL;
+
+    ret = tls_api_init_ctx_ex(&test_ctx,
+        PICOQUIC_INTERNAL_TEST_VERSION_1,
+        PICOQUIC_TEST_SNI, alpn, &simulated_time, NULL, NULL, 0, 1, 0, &initial_cid);
+
+    if (ret == 0) {
+        picowt_set_transport_parameters(test_ctx->cnx_client);
+        if ((bench = wt_baton_bench_create(nb_sessions)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        h3zero_stream_ctx_t* control_stream_ctx = NULL;
+
+        ret = picowt_prepare_client_cnx(test_ctx->qclient, (struct sockaddr*)NULL,
+            &test_ctx->cnx_client, &h3zero_cb, &control_stream_ctx, simulated_time, PICOQUIC_TEST_SNI);
+
+        if (ret == 0) {
+            ret = wt_baton_bench_connect(test_ctx->cnx_client, bench, h3zero_cb, control_stream_ctx,
+                PICOQUIC_TEST_SNI, baton_path);
+        }
+
+        if (ret == 0) {
+            ret = picoquic_start_client_cnx(test_ctx->cnx_client);
+        }
+
+        if (ret == 0) {
+            memset(&server_param, 0, sizeof(picohttp_server_parameters_t));
+            server_param.web_folder = NULL;
+            server_param.path_table = path_item_list;
+            server_param.path_table_nb = 1;
+
+            picoquic_set_alpn_select_fn(test_ctx->qserver, picoquic_demo_server_callback_select_alpn);
+            picoquic_set_default_callback(test_ctx->qserver, h3zero_callback, &server_param);
+        }
+    }
+
+    if (ret == 0) {
+        ret = tls_api_connection_loop(test_ctx, &loss_mask, 0, &simulated_time);
+    }
+
+    time_out = simulated_time + 30000000;
+    while (ret == 0 && picoquic_get_cnx_state(test_ctx->cnx_client) != picoquic_state_disconnected) {
+        ret = tls_api_one_sim_round(test_ctx, &simulated_time, time_out, &was_active);
+
+        if (ret != 0) {
+            DBG_PRINTF("Simulation error detected after %d trials\n", nb_trials);
+            break;
+        }
+
+        if (++nb_trials > 100000) {
+            DBG_PRINTF("Simulation not concluded after %d trials\n", nb_trials);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0 && bench->nb_sessions_closed != nb_sessions) {
+        DBG_PRINTF("Only %zu sessions closed out of %zu", bench->nb_sessions_closed, nb_sessions);
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_sessions; i++) {
+        wt_baton_ctx_t* baton_ctx = &bench->sessions[i];
+
+        if (baton_ctx->nb_turns < 8 || baton_ctx->lanes_completed != baton_ctx->nb_lanes ||
+            baton_ctx->nb_datagrams_sent == 0 || baton_ctx->nb_datagrams_received == 0) {
+            DBG_PRINTF("Session %zu fails after %d turns, %" PRIu64 " lanes completed, %d datagrams sent, %d received",
+                i, baton_ctx->nb_turns, baton_ctx->lanes_completed, baton_ctx->nb_datagrams_sent, baton_ctx->nb_datagrams_received);
+            ret = -1;
+        }
+        else if (baton_ctx->nb_baton_bytes_sent < ((uint64_t)baton_ctx->nb_turns) * 1000 ||
+            baton_ctx->nb_datagram_bytes_sent != ((size_t)baton_ctx->nb_datagrams_sent) * 200) {
+            DBG_PRINTF("Session %zu, unexpected sizes, %" PRIu64 " bytes for %d turns, %zu bytes for %d datagrams",
+                i, baton_ctx->nb_baton_bytes_sent, baton_ctx->nb_turns, baton_ctx->nb_datagram_bytes_sent, baton_ctx->nb_datagrams_sent);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (bench->latency.count == 0 || bench->start_time == 0 || bench->end_time <= bench->start_time)) {
+        DBG_PRINTF("Latency not recorded, count %" PRIu64, bench->latency.count);
+        ret = -1;
+    }
+
+    if (h3zero_cb != NULL) {
+        h3zero_callback_delete_context(test_ctx->cnx_client, h3zero_cb);
+    }
+
+    if (test_ctx != NULL) {
+        tls_api_delete_ctx(test_ctx);
+        test_ctx = NULL;
+    }
+
+    wt_baton_bench_delete(bench);
+
+    return ret;
+}
+
 int picowt_tp_test()
 {
     picoquic_quic_t* quic = NULL;
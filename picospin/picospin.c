@@ -0,0 +1,402 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2024, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+* Passive spin bit RTT observer.
+*
+* The observer reads packets from a capture file in the classic pcap
+* format, or on Linux from a network interface through an AF_PACKET
+* socket, and feeds them to the spin bit observer library. When a flow
+* ends, i.e., when it is idle for longer than the idle timeout, when it is
+* evicted from the flow table, or at the end of the capture, a line of CSV
+* is written with the flow addresses, the packet and edge counts, the RTT
+* statistics, and the non empty buckets of the RTT histogram, formatted as
+* "floor:count" pairs separated by spaces, where floor is the lower bound
+* of the bucket in microseconds.
+*
+* The observer does not decrypt anything, and does not need access to the
+* endpoints. Reading from an interface requires the CAP_NET_RAW capability.
+*/
+
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Required for recvmmsg */
+#endif
+#endif
+#ifdef _WINDOWS
+#include "getopt.h"
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "picoquic_spin_observer.h"
+
+#define PICOSPIN_FLOWS_DEFAULT 65536
+#define PICOSPIN_CAPTURE_MAX 0x40000
+#define PICOSPIN_BATCH 32
+#define PICOSPIN_SNAP_LENGTH 0x10000
+#define PICOSPIN_EXPIRE_INTERVAL 1000000ull
+
+static void picospin_print_addr(FILE* F, uint8_t ip_version, const uint8_t* addr)
+{
+    if (ip_version == 6) {
+        for (int i = 0; i < 16; i += 2) {
+            fprintf(F, "%s%x", (i == 0) ? "" : ":", ((unsigned int)addr[i] << 8) | addr[i + 1]);
+        }
+    }
+    else {
+        fprintf(F, "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+    }
+}
+
+static void picospin_print_header(FILE* F)
+{
+    fprintf(F, "addr_0,port_0,addr_1,port_1,first_time,last_time,packets_0,packets_1,edges,rejected,samples,"
+        "rtt_min,rtt_avg,rtt_p50,rtt_p90,rtt_p99,rtt_max,histogram\n");
+}
+
+static void picospin_flow_end(picoquic_spinobs_t* obs, const picoquic_spinobs_flow_t* flow, void* flow_end_ctx)
+{
+    FILE* F = (FILE*)flow_end_ctx;
+    (void)obs;
+
+    for (int i = 0; i < 2; i++) {
+        picospin_print_addr(F, flow->key.ip_version, flow->key.addr[i]);
+        fprintf(F, ",%u,", flow->key.port[i]);
+    }
+    fprintf(F, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",",
+        flow->first_time, flow->last_time, flow->direction[0].nb_packets, flow->direction[1].nb_packets,
+        flow->nb_edges, flow->nb_edges_rejected, flow->nb_samples);
+    if (flow->nb_samples > 0) {
+        int is_first = 1;
+        fprintf(F, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",",
+            flow->rtt_min, flow->rtt_sum / flow->nb_samples, picoquic_spinobs_percentile(flow, 50),
+            picoquic_spinobs_percentile(flow, 90), picoquic_spinobs_percentile(flow, 99), flow->rtt_max);
+        for (int i = 0; i < PICOQUIC_SPINOBS_NB_BUCKETS; i++) {
+            if (flow->histogram[i] > 0) {
+                fprintf(F, "%s%" PRIu64 ":%u", (is_first) ? "" : " ", picoquic_spinobs_bucket_floor(i), flow->histogram[i]);
+                is_first = 0;
+            }
+        }
+        fprintf(F, "\n");
+    }
+    else {
+        fprintf(F, ",,,,,,\n");
+    }
+}
+
+static uint32_t picospin_pcap_uint32(const uint8_t* bytes, int is_swapped)
+{
+    return (is_swapped) ?
+        (((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3]) :
+        ((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+}
+
+static int picospin_read_pcap(picoquic_spinobs_t* obs, char const* pcap_file)
+{
+    int ret = 0;
+    FILE* F = fopen(pcap_file, "rb");
+    uint8_t header[24];
+    uint8_t* buffer = (uint8_t*)malloc(PICOSPIN_CAPTURE_MAX);
+    int is_swapped = 0;
+    int is_nano = 0;
+    uint32_t link_type = 0;
+    uint64_t next_expire = 0;
+
+    if (F == NULL || buffer == NULL) {
+        fprintf(stderr, "Cannot open capture file: %s\n", pcap_file);
+        ret = -1;
+    }
+    else if (fread(header, 1, sizeof(header), F) != sizeof(header)) {
+        ret = -1;
+    }
+    else {
+        /* The magic number tells the byte order, and whether time stamps are
+         * in microseconds or nanoseconds. */
+        uint32_t magic = picospin_pcap_uint32(header, 1);
+
+        if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+            is_swapped = 1;
+        }
+        else if (magic != 0xd4c3b2a1 && magic != 0x4d3cb2a1) {
+            ret = -1;
+        }
+        is_nano = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+        link_type = picospin_pcap_uint32(header + 20, is_swapped) & 0xffff;
+    }
+
+    if (ret != 0 && F != NULL) {
+        fprintf(stderr, "Not a pcap file: %s (pcapng is not supported)\n", pcap_file);
+    }
+
+    while (ret == 0) {
+        uint8_t record_header[16];
+        uint32_t captured_length;
+        uint64_t current_time;
+
+        if (fread(record_header, 1, sizeof(record_header), F) != sizeof(record_header)) {
+            break;
+        }
+        current_time = (uint64_t)picospin_pcap_uint32(record_header, is_swapped) * 1000000ull;
+        current_time += (is_nano) ? picospin_pcap_uint32(record_header + 4, is_swapped) / 1000 :
+            picospin_pcap_uint32(record_header + 4, is_swapped);
+        captured_length = picospin_pcap_uint32(record_header + 8, is_swapped);
+        if (captured_length > PICOSPIN_CAPTURE_MAX ||
+            fread(buffer, 1, captured_length, F) != captured_length) {
+            fprintf(stderr, "Truncated capture file: %s\n", pcap_file);
+            ret = -1;
+        }
+        else {
+            (void)picoquic_spinobs_process_frame(obs, link_type, buffer, captured_length, current_time);
+            if (current_time >= next_expire) {
+                picoquic_spinobs_expire(obs, current_time);
+                next_expire = current_time + PICOSPIN_EXPIRE_INTERVAL;
+            }
+        }
+    }
+
+    if (F != NULL) {
+        (void)fclose(F);
+    }
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return ret;
+}
+
+#ifdef __linux__
+static volatile sig_atomic_t picospin_stop = 0;
+
+static void picospin_on_signal(int sig)
+{
+    (void)sig;
+    picospin_stop = 1;
+}
+
+static uint64_t picospin_current_time()
+{
+    struct timeval tv;
+    (void)gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000ull + (uint64_t)tv.tv_usec;
+}
+
+/* Receive the packets in batches with recvmmsg. The SOCK_DGRAM flavor of
+ * AF_PACKET removes the link layer header, so the packets start with the
+ * IP header. */
+static int picospin_read_interface(picoquic_spinobs_t* obs, char const* if_name)
+{
+    int ret = 0;
+    int fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+    uint8_t* buffer = (uint8_t*)malloc((size_t)PICOSPIN_BATCH * PICOSPIN_SNAP_LENGTH);
+    struct mmsghdr msg[PICOSPIN_BATCH];
+    struct iovec iov[PICOSPIN_BATCH];
+    uint64_t next_expire = 0;
+
+    if (fd < 0 || buffer == NULL) {
+        fprintf(stderr, "Cannot open packet socket, error %d\n", errno);
+        ret = -1;
+    }
+    else if (if_name != NULL) {
+        struct sockaddr_ll sll;
+
+        memset(&sll, 0, sizeof(sll));
+        sll.sll_family = AF_PACKET;
+        sll.sll_protocol = htons(ETH_P_ALL);
+        sll.sll_ifindex = (int)if_nametoindex(if_name);
+        if (sll.sll_ifindex == 0 || bind(fd, (struct sockaddr*)&sll, sizeof(sll)) != 0) {
+            fprintf(stderr, "Cannot bind to interface %s, error %d\n", if_name, errno);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        (void)signal(SIGINT, picospin_on_signal);
+        (void)signal(SIGTERM, picospin_on_signal);
+        memset(msg, 0, sizeof(msg));
+        for (int i = 0; i < PICOSPIN_BATCH; i++) {
+            iov[i].iov_base = buffer + (size_t)i * PICOSPIN_SNAP_LENGTH;
+            iov[i].iov_len = PICOSPIN_SNAP_LENGTH;
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    while (ret == 0 && !picospin_stop) {
+        struct pollfd pfd;
+        int nb_received;
+        uint64_t current_time;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) > 0 &&
+            (nb_received = recvmmsg(fd, msg, PICOSPIN_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+            /* All the packets of a batch get the same time stamp */
+            current_time = picospin_current_time();
+            for (int i = 0; i < nb_received; i++) {
+                (void)picoquic_spinobs_process_ip(obs, (uint8_t*)iov[i].iov_base, msg[i].msg_len, current_time);
+            }
+        }
+        else {
+            current_time = picospin_current_time();
+        }
+        if (current_time >= next_expire) {
+            picoquic_spinobs_expire(obs, current_time);
+            next_expire = current_time + PICOSPIN_EXPIRE_INTERVAL;
+        }
+    }
+
+    if (fd >= 0) {
+        (void)close(fd);
+    }
+    if (buffer != NULL) {
+        free(buffer);
+    }
+
+    return ret;
+}
+#endif
+
+static int usage(char const* argv0)
+{
+    fprintf(stderr, "Usage: %s -r capture.pcap [options]\n", argv0);
+#ifdef __linux__
+    fprintf(stderr, "   Or: %s -i interface [options]\n", argv0);
+#endif
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -o file.csv     Write the flow records to the file instead of stdout\n");
+    fprintf(stderr, "  -n nb_flows     Size of the flow table, default %d\n", PICOSPIN_FLOWS_DEFAULT);
+    fprintf(stderr, "  -t seconds      Idle timeout of the flows, default %d\n", (int)(PICOQUIC_SPINOBS_FLOW_IDLE / 1000000));
+    fprintf(stderr, "  -s              Track flows first seen in the middle of a connection\n");
+    fprintf(stderr, "  -h              Print this help message\n");
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
+    int opt;
+    char const* pcap_file = NULL;
+    char const* if_name = NULL;
+    char const* out_file = NULL;
+    size_t nb_flows = PICOSPIN_FLOWS_DEFAULT;
+    uint64_t idle_timeout = PICOQUIC_SPINOBS_FLOW_IDLE;
+    int create_on_short_header = 0;
+    FILE* F = stdout;
+    picoquic_spinobs_t obs;
+
+    while (ret == 0 && (opt = getopt(argc, argv, "r:i:o:n:t:sh")) != -1) {
+        switch (opt) {
+        case 'r':
+            pcap_file = optarg;
+            break;
+        case 'i':
+            if_name = optarg;
+            break;
+        case 'o':
+            out_file = optarg;
+            break;
+        case 'n':
+            if ((nb_flows = (size_t)strtoul(optarg, NULL, 10)) == 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 't':
+            if ((idle_timeout = (uint64_t)strtoul(optarg, NULL, 10) * 1000000ull) == 0) {
+                ret = usage(argv[0]);
+            }
+            break;
+        case 's':
+            create_on_short_header = 1;
+            break;
+        case 'h':
+        default:
+            ret = usage(argv[0]);
+            break;
+        }
+    }
+
+    if (ret == 0 && (pcap_file == NULL) == (if_name == NULL)) {
+        ret = usage(argv[0]);
+    }
+#ifndef __linux__
+    if (ret == 0 && if_name != NULL) {
+        fprintf(stderr, "Interface capture is only supported on Linux\n");
+        ret = -1;
+    }
+#endif
+
+    if (ret == 0 && out_file != NULL && (F = fopen(out_file, "w")) == NULL) {
+        fprintf(stderr, "Cannot open output file: %s\n", out_file);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        if (picoquic_spinobs_init(&obs, nb_flows, (uint64_t)time(NULL)) != 0) {
+            fprintf(stderr, "Cannot allocate a table of %zu flows\n", nb_flows);
+            ret = -1;
+        }
+        else {
+            obs.idle_timeout = idle_timeout;
+            obs.create_on_short_header = create_on_short_header;
+            picoquic_spinobs_set_flow_end_callback(&obs, picospin_flow_end, F);
+            picospin_print_header(F);
+
+            if (pcap_file != NULL) {
+                ret = picospin_read_pcap(&obs, pcap_file);
+            }
+#ifdef __linux__
+            else {
+                ret = picospin_read_interface(&obs, if_name);
+            }
+#endif
+            picoquic_spinobs_flush(&obs);
+            fprintf(stderr, "Datagrams: %" PRIu64 ", not QUIC: %" PRIu64 ", short headers: %" PRIu64
+                ", RTT samples: %" PRIu64 ", flows: %" PRIu64 ", evicted: %" PRIu64 "\n",
+                obs.nb_datagrams, obs.nb_not_quic, obs.nb_short_packets, obs.nb_samples,
+                obs.nb_flows_created, obs.nb_flows_evicted);
+            picoquic_spinobs_clear(&obs);
+        }
+    }
+
+    if (F != NULL && F != stdout) {
+        (void)fclose(F);
+    }
+
+    return (ret == 0) ? 0 : 1;
+}
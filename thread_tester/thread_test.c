@@ -62,7 +62,7 @@
 #include "picoquic.h"
 #include "picoquic_internal.h"
 #include "picoquic_utils.h"
-/* #include "picoquic_packet_loop.h" */
+#include "picoquic_packet_loop.h"
 /* #include "picoquic_unified_log.h" */
 
 /* Thread context, passed as parameter when starting network thread */
@@ -547,6 +547,372 @@ void* event_loop_thread(void* lpParam)
 #endif
 }
 
+/* Wake up latency benchmark.
+ *
+ * The benchmark measures the delay between a call on an application thread
+ * and the execution of the matching code in a picoquic network thread:
+ * either the delay from picoquic_wake_up_network_thread to the
+ * picoquic_packet_loop_wake_up callback, or the delay from
+ * picoquic_post_network_callback to the execution of the command posted
+ * in the lock free queue. The wake up signal is an event on Windows, an
+ * eventfd or a pipe on Linux, and a pipe on other systems.
+ *
+ * Samples are taken one at a time, with a short pause between them, so
+ * that each sample measures a wake up of an idle network thread. Each
+ * mechanism is measured without load, with a flow of UDP packets sent to
+ * the network thread, and with threads spinning on the CPU.
+ */
+#define WAKE_BENCH_NB_SAMPLES 10000
+#define WAKE_BENCH_PORT 4455
+#define WAKE_BENCH_LOAD_PPS 20000
+#define WAKE_BENCH_CPU_THREADS 2
+#define WAKE_BENCH_CPU_THREADS_MAX 64
+#define WAKE_BENCH_TIMEOUT 1000000
+
+#ifdef _WINDOWS
+#define WAKE_BENCH_PAUSE_US(x) Sleep((DWORD)(((x) + 999)/1000))
+#else
+#define WAKE_BENCH_PAUSE_US(x) usleep(x)
+#endif
+
+typedef struct st_wake_bench_mechanism_t {
+    char const* name;
+    int use_pipe;
+    int use_command_queue;
+} wake_bench_mechanism_t;
+
+static const wake_bench_mechanism_t wake_bench_mechanisms[] = {
+#if defined(_WINDOWS)
+    { "event", 0, 0 },
+#elif defined(__linux__)
+    { "eventfd", 0, 0 },
+    { "pipe", 1, 0 },
+#else
+    { "pipe", 0, 0 },
+#endif
+    { "queue", 0, 1 }
+};
+
+typedef enum {
+    wake_bench_load_none = 0,
+    wake_bench_load_udp,
+    wake_bench_load_cpu
+} wake_bench_load_enum;
+
+static char const* wake_bench_load_names[] = { "idle", "udp", "cpu" };
+
+typedef struct st_wake_bench_ctx_t {
+    picoquic_network_thread_ctx_t* thread_ctx;
+    int use_command_queue;
+    int nb_samples;
+    uint64_t* latency;
+    volatile uint64_t sent_at;
+    volatile int is_pending;
+    volatile int nb_received;
+    volatile int load_should_stop;
+    uint16_t port;
+    int load_pps;
+    uint64_t nb_load_packets;
+} wake_bench_ctx_t;
+
+/* Record the latency of the pending sample, in the network thread */
+static void wake_bench_record(wake_bench_ctx_t* bench)
+{
+    if (bench->is_pending) {
+        uint64_t current_time = picoquic_current_time();
+        if (bench->nb_received < bench->nb_samples) {
+            bench->latency[bench->nb_received] = current_time - bench->sent_at;
+            bench->nb_received++;
+        }
+        bench->is_pending = 0;
+    }
+}
+
+static void wake_bench_command(picoquic_quic_t* quic, void* app_ctx)
+{
+    (void)quic;
+    wake_bench_record((wake_bench_ctx_t*)app_ctx);
+}
+
+static int wake_bench_loop_cb(picoquic_quic_t* quic, picoquic_packet_loop_cb_enum cb_mode,
+    void* callback_ctx, void* callback_arg)
+{
+    wake_bench_ctx_t* bench = (wake_bench_ctx_t*)callback_ctx;
+    (void)quic;
+    (void)callback_arg;
+
+    if (cb_mode == picoquic_packet_loop_wake_up && !bench->use_command_queue) {
+        wake_bench_record(bench);
+    }
+    return 0;
+}
+
+/* UDP load: bursts of packets sent to the network thread every millisecond */
+#ifdef _WINDOWS
+DWORD WINAPI wake_bench_udp_load_thread(LPVOID lpParam)
+#else
+void* wake_bench_udp_load_thread(void* lpParam)
+#endif
+{
+    wake_bench_ctx_t* bench = (wake_bench_ctx_t*)lpParam;
+    SOCKET_TYPE l_socket;
+    struct sockaddr_in addr;
+    uint8_t buffer[256];
+    int burst = (bench->load_pps + 999) / 1000;
+
+    memset(buffer, 0, sizeof(buffer));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((l_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+        DBG_PRINTF("%s", "Cannot open the load socket");
+    }
+    else {
+        while (!bench->load_should_stop) {
+            for (int i = 0; i < burst; i++) {
+                picoformat_64(buffer + 1, bench->nb_load_packets);
+                if (sendto(l_socket, (const char*)buffer, (int)sizeof(buffer), 0,
+                    (struct sockaddr*)&addr, (socklen_t)sizeof(addr)) == (int)sizeof(buffer)) {
+                    bench->nb_load_packets++;
+                }
+            }
+            SLEEP(1);
+        }
+        SOCKET_CLOSE(l_socket);
+    }
+#ifdef _WINDOWS
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/* CPU load: spin until the end of the measurement */
+#ifdef _WINDOWS
+DWORD WINAPI wake_bench_cpu_load_thread(LPVOID lpParam)
+#else
+void* wake_bench_cpu_load_thread(void* lpParam)
+#endif
+{
+    wake_bench_ctx_t* bench = (wake_bench_ctx_t*)lpParam;
+    volatile uint64_t x = 0;
+
+    while (!bench->load_should_stop) {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+    }
+#ifdef _WINDOWS
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static int wake_bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static uint64_t wake_bench_percentile(uint64_t* sorted, int nb, int per_thousand)
+{
+    int rank = (int)(((int64_t)nb * per_thousand) / 1000);
+    if (rank >= nb) {
+        rank = nb - 1;
+    }
+    return sorted[rank];
+}
+
+static int wake_bench_run(wake_bench_mechanism_t const* mechanism, wake_bench_load_enum load,
+    int nb_samples, uint16_t port, int load_pps, int nb_cpu_threads)
+{
+    int ret = 0;
+    wake_bench_ctx_t bench;
+    picoquic_quic_t* quic = NULL;
+    picoquic_packet_loop_param_t param;
+    picoquic_thread_t t_load[WAKE_BENCH_CPU_THREADS_MAX];
+    int nb_load_threads = 0;
+    uint64_t mean = 0;
+
+    memset(&bench, 0, sizeof(bench));
+    memset(&param, 0, sizeof(param));
+    bench.use_command_queue = mechanism->use_command_queue;
+    bench.nb_samples = nb_samples;
+    bench.port = port;
+    bench.load_pps = load_pps;
+    param.local_port = port;
+    param.local_af = AF_INET;
+    param.wake_up_use_pipe = mechanism->use_pipe;
+
+    if ((bench.latency = (uint64_t*)malloc(sizeof(uint64_t) * nb_samples)) == NULL) {
+        DBG_PRINTF("Cannot allocate %d samples", nb_samples);
+        ret = -1;
+    }
+    else if ((quic = picoquic_create(8, NULL, NULL, NULL, "bench", NULL, NULL, NULL, NULL, NULL,
+        picoquic_current_time(), NULL, NULL, NULL, 0)) == NULL) {
+        DBG_PRINTF("%s", "Cannot create the quic context");
+        ret = -1;
+    }
+    else if ((bench.thread_ctx = picoquic_start_network_thread(quic, &param, wake_bench_loop_cb,
+        &bench, &ret)) == NULL) {
+        DBG_PRINTF("Cannot start the network thread, ret = %d (0x%x)", ret, ret);
+        if (ret == 0) {
+            ret = -1;
+        }
+    }
+    else {
+        for (int i = 0; i < 2000 && !bench.thread_ctx->thread_is_ready &&
+            !bench.thread_ctx->thread_is_closed; i++) {
+            SLEEP(1);
+        }
+        if (!bench.thread_ctx->thread_is_ready) {
+            DBG_PRINTF("%s", "Network thread not started in time");
+            ret = -1;
+        }
+    }
+
+    /* Start the load */
+    if (ret == 0 && load != wake_bench_load_none) {
+        int nb_threads = (load == wake_bench_load_udp) ? 1 : nb_cpu_threads;
+        for (int i = 0; ret == 0 && i < nb_threads; i++) {
+            if ((ret = picoquic_create_thread(&t_load[i], (load == wake_bench_load_udp) ?
+                wake_bench_udp_load_thread : wake_bench_cpu_load_thread, &bench)) != 0) {
+                DBG_PRINTF("Cannot create load thread, ret= 0x%x", ret);
+            }
+            else {
+                nb_load_threads++;
+            }
+        }
+        /* Let the load settle */
+        SLEEP(100);
+    }
+
+    /* Take the samples one at a time */
+    for (int i = 0; ret == 0 && i < nb_samples; i++) {
+        int wait_us = 0;
+
+        WAKE_BENCH_PAUSE_US(100 + (i % 7) * 131);
+        bench.sent_at = picoquic_current_time();
+        bench.is_pending = 1;
+        if (bench.use_command_queue) {
+            ret = picoquic_post_network_callback(bench.thread_ctx, wake_bench_command, &bench);
+        }
+        else {
+            ret = picoquic_wake_up_network_thread(bench.thread_ctx);
+        }
+        if (ret != 0) {
+            DBG_PRINTF("Wake up returns %d (0x%x)", ret, ret);
+            break;
+        }
+        while (bench.is_pending && wait_us < WAKE_BENCH_TIMEOUT) {
+            WAKE_BENCH_PAUSE_US(20);
+            wait_us += 20;
+        }
+        if (bench.is_pending) {
+            DBG_PRINTF("Sample %d not received after %d us", i, wait_us);
+            ret = -1;
+        }
+    }
+
+    /* Stop the load, then the network thread */
+    bench.load_should_stop = 1;
+    for (int i = 0; i < nb_load_threads; i++) {
+        (void)picoquic_wait_thread(t_load[i]);
+    }
+    if (bench.thread_ctx != NULL) {
+        picoquic_delete_network_thread(bench.thread_ctx);
+    }
+    if (quic != NULL) {
+        picoquic_free(quic);
+    }
+
+    if (ret == 0 && bench.nb_received > 0) {
+        int nb = bench.nb_received;
+
+        qsort(bench.latency, nb, sizeof(uint64_t), wake_bench_compare);
+        for (int i = 0; i < nb; i++) {
+            mean += bench.latency[i];
+        }
+        mean /= nb;
+        printf("%-8s %-5s %6d %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64 "\n",
+            mechanism->name, wake_bench_load_names[load], nb,
+            bench.latency[0], wake_bench_percentile(bench.latency, nb, 500),
+            wake_bench_percentile(bench.latency, nb, 900), wake_bench_percentile(bench.latency, nb, 990),
+            wake_bench_percentile(bench.latency, nb, 999), bench.latency[nb - 1], mean);
+    }
+    else if (ret != 0) {
+        printf("%-8s %-5s failed, ret = %d (0x%x)\n", mechanism->name, wake_bench_load_names[load], ret, ret);
+    }
+
+    if (bench.latency != NULL) {
+        free(bench.latency);
+    }
+    return ret;
+}
+
+static void wake_bench_usage(char const* argv0)
+{
+    printf("Usage: %s [-b [-n nb_samples] [-l load_pps] [-c cpu_threads] [-p port]]\n", argv0);
+    printf("  Without arguments, test the thread execution.\n");
+    printf("  -b              run the wake up latency benchmark.\n");
+    printf("  -n nb_samples   samples per measurement, default %d.\n", WAKE_BENCH_NB_SAMPLES);
+    printf("  -l load_pps     packets per second of the UDP load, default %d, 0 to skip.\n", WAKE_BENCH_LOAD_PPS);
+    printf("  -c cpu_threads  spinning threads of the CPU load, default %d, 0 to skip.\n", WAKE_BENCH_CPU_THREADS);
+    printf("  -p port         port of the network thread, default %d.\n", WAKE_BENCH_PORT);
+}
+
+int wake_bench_main(int argc, char** argv)
+{
+    int ret = 0;
+    int nb_samples = WAKE_BENCH_NB_SAMPLES;
+    int load_pps = WAKE_BENCH_LOAD_PPS;
+    int nb_cpu_threads = WAKE_BENCH_CPU_THREADS;
+    int port = WAKE_BENCH_PORT;
+
+    for (int i = 2; ret == 0 && i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+            nb_samples = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-l") == 0) {
+            load_pps = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+            nb_cpu_threads = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[++i]);
+        }
+        else {
+            ret = -1;
+        }
+    }
+    if (ret != 0 || nb_samples <= 0 || load_pps < 0 || nb_cpu_threads < 0 ||
+        nb_cpu_threads > WAKE_BENCH_CPU_THREADS_MAX || port <= 0 || port > 0xffff) {
+        wake_bench_usage(argv[0]);
+        ret = -1;
+    }
+    else {
+        printf("Wake up latency, microseconds.\n");
+        printf("%-8s %-5s %6s %6s %6s %6s %6s %6s %6s %6s\n", "wake", "load", "nb", "min",
+            "p50", "p90", "p99", "p99.9", "max", "mean");
+        for (size_t m = 0; m < sizeof(wake_bench_mechanisms) / sizeof(wake_bench_mechanism_t); m++) {
+            for (int load = wake_bench_load_none; load <= wake_bench_load_cpu; load++) {
+                if ((load == wake_bench_load_udp && load_pps == 0) ||
+                    (load == wake_bench_load_cpu && nb_cpu_threads == 0)) {
+                    continue;
+                }
+                if (wake_bench_run(&wake_bench_mechanisms[m], (wake_bench_load_enum)load,
+                    nb_samples, (uint16_t)port, load_pps, nb_cpu_threads) != 0) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+    return ret;
+}
+
 int main(int argc, char** argv)
 {
     int ret = 0;
@@ -560,6 +926,16 @@ int main(int argc, char** argv)
     WSADATA wsaData = { 0 };
     (void)WSA_START(MAKEWORD(2, 2), &wsaData);
 #endif
+    if (argc > 1) {
+        if (strcmp(argv[1], "-b") == 0) {
+            ret = wake_bench_main(argc, argv);
+        }
+        else {
+            wake_bench_usage(argv[0]);
+            ret = -1;
+        }
+        exit(ret);
+    }
     printf("testing the thread execution\n");
 
     debug_set_stream(stdout);